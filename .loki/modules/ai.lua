@@ -7,6 +7,34 @@ local M = {}
 -- Detect execution mode (editor or REPL)
 local MODE = loki.get_lines and "editor" or "repl"
 
+local ENDPOINT = "https://api.openai.com/v1/chat/completions"
+
+-- Unescape a JSON string's contents
+local function unescape(s)
+    s = s:gsub('\\n', '\n')
+    s = s:gsub('\\t', '\t')
+    s = s:gsub('\\"', '"')
+    s = s:gsub('\\\\', '\\')
+    return s
+end
+
+-- The prompt for a request body, as a JSON string: prefix .. text, or
+-- prefix and the buffer around the cursor (the selected lines, if any),
+-- built in C with each line escaped once and cached between requests
+local function prompt_json(prefix, text)
+    if text then
+        return string.format("%q", (prefix or "") .. text)
+    end
+    if loki.ai_context then
+        return loki.ai_context({prefix = prefix, selection = true})
+    end
+    local lines = {}
+    for i = 0, loki.get_lines() - 1 do
+        table.insert(lines, loki.get_line(i))
+    end
+    return string.format("%q", (prefix or "") .. table.concat(lines, "\n"))
+end
+
 -- Internal: response handler for AI requests
 local function response_handler(response)
     if not response then
@@ -69,11 +97,7 @@ local function response_handler(response)
     end
 
     if content then
-        -- Unescape JSON string
-        content = content:gsub('\\n', '\n')
-        content = content:gsub('\\t', '\t')
-        content = content:gsub('\\"', '"')
-        content = content:gsub('\\\\', '\\')
+        content = unescape(content)
 
         -- Output response based on context
         if MODE == "editor" then
@@ -105,14 +129,10 @@ function M.complete(text)
 
     if text then
         -- Explicit text provided
-        prompt = text
+        prompt = prompt_json(nil, text)
     elseif MODE == "editor" then
-        -- Editor context: get buffer content
-        local lines = {}
-        for i = 0, loki.get_lines() - 1 do
-            table.insert(lines, loki.get_line(i))
-        end
-        prompt = table.concat(lines, "\n")
+        -- Editor context: the buffer around the cursor
+        prompt = prompt_json(nil)
     else
         -- REPL context without text: error
         print("Usage: ai.complete('your prompt text')")
@@ -136,7 +156,7 @@ function M.complete(text)
   "messages": [
     {"role": "user", "content": %s}
   ]
-}]], string.format("%q", prompt))
+}]], prompt)
 
     -- Set up headers
     local headers = {
@@ -146,7 +166,7 @@ function M.complete(text)
 
     -- Make async HTTP request (non-blocking)
     loki.async_http(
-        "https://api.openai.com/v1/chat/completions",
+        ENDPOINT,
         "POST",
         json_body,
         headers,
@@ -164,19 +184,10 @@ end
 -- In editor: ai.explain() uses buffer content
 -- In REPL: ai.explain("code to explain")
 function M.explain(code)
-    if not code then
-        if MODE == "editor" then
-            -- Editor context: get buffer content
-            local lines = {}
-            for i = 0, loki.get_lines() - 1 do
-                table.insert(lines, loki.get_line(i))
-            end
-            code = table.concat(lines, "\n")
-        else
-            -- REPL context without text: error
-            print("Usage: ai.explain('code to explain')")
-            return
-        end
+    if not code and MODE ~= "editor" then
+        -- REPL context without text: error
+        print("Usage: ai.explain('code to explain')")
+        return
     end
 
     local api_key = os.getenv("OPENAI_API_KEY")
@@ -189,13 +200,14 @@ function M.explain(code)
         return
     end
 
-    local prompt = "Explain this code concisely:\n\n" .. code
+    -- Editor context without code: the buffer around the cursor
+    local prompt = prompt_json("Explain this code concisely:\n\n", code)
     local json_body = string.format([[{
   "model": "gpt-4o-mini",
   "messages": [
     {"role": "user", "content": %s}
   ]
-}]], string.format("%q", prompt))
+}]], prompt)
 
     local headers = {
         "Content-Type: application/json",
@@ -203,7 +215,7 @@ function M.explain(code)
     }
 
     loki.async_http(
-        "https://api.openai.com/v1/chat/completions",
+        ENDPOINT,
         "POST",
         json_body,
         headers,
@@ -217,6 +229,108 @@ function M.explain(code)
     end
 end
 
+-- Internal: send a streaming request for 'prompt' (a JSON string), calling
+-- on_token(text) with each token as it arrives and on_done(streamed) at
+-- the end unless the request failed. Returns false if it was not sent.
+local function stream_request(prompt, on_token, on_done)
+    local api_key = os.getenv("OPENAI_API_KEY")
+    if not api_key or api_key == "" then
+        loki.status("Error: OPENAI_API_KEY environment variable not set")
+        return false
+    end
+
+    local json_body = string.format([[{
+  "model": "gpt-4o-mini",
+  "stream": true,
+  "messages": [
+    {"role": "user", "content": %s}
+  ]
+}]], prompt)
+
+    local headers = {
+        "Content-Type: application/json",
+        "Accept: text/event-stream",
+        "Authorization: Bearer " .. api_key
+    }
+
+    local started = false
+    local function on_chunk(data)
+        if data == "[DONE]" then return end
+        local token = data:match('"delta"%s*:%s*{.-"content"%s*:%s*"(.-[^\\])"')
+        if token then
+            on_token(unescape(token), not started)
+            started = true
+        end
+    end
+
+    _G.ai_stream_done = function(response)
+        if response.error then
+            loki.status("Error: " .. response.error)
+        else
+            on_done(started)
+        end
+    end
+
+    local id = loki.async_http(ENDPOINT, "POST", json_body, headers, "ai_stream_done",
+                               { on_chunk = on_chunk, sse = true })
+    return id ~= nil
+end
+
+-- Stream a completion into the buffer token by token as it arrives
+-- (editor only; needs a loki.async_http that streams)
+function M.stream(text)
+    if MODE ~= "editor" then
+        print("Usage: ai.stream() streams into the buffer; use ai.complete() here")
+        return
+    end
+
+    local sent = stream_request(prompt_json(nil, text), function(token, first)
+        if first then loki.stream_text("\n\n--- AI Response ---\n") end
+        loki.stream_text(token)
+    end, function(streamed)
+        if streamed then
+            loki.stream_text("\n---\n")
+            loki.status("AI response streamed")
+        end
+    end)
+    if sent then loki.status("AI request sent... (streaming)") end
+end
+
+-- Suggest a continuation at the cursor, streamed in as ghost text that is
+-- drawn but not inserted: TAB in INSERT mode takes it as one edit (one
+-- undo step), any other key drops it. Tokens redraw only the cursor's row.
+function M.suggest()
+    if MODE ~= "editor" or not loki.ghost_append then
+        print("Usage: ai.suggest() shows a suggestion in the editor")
+        return
+    end
+
+    local prefix = "Continue this text from its end. Reply with the continuation only.\n\n"
+    local prompt = loki.ai_context and loki.ai_context({prefix = prefix, after = 0})
+                   or prompt_json(prefix)
+    loki.ghost_clear()
+    local sent = stream_request(prompt, function(token)
+        loki.ghost_append(token)
+    end, function(streamed)
+        loki.status(streamed and "Suggestion ready: TAB to accept" or "No suggestion")
+    end)
+    if sent then loki.status("AI suggestion requested...") end
+end
+
+-- Connect to the API ahead of the first request, so it does not wait for
+-- DNS, TCP and TLS. Returns true if started.
+function M.preconnect()
+    if not loki.http_preconnect then return false end
+    return loki.http_preconnect(ENDPOINT) == true
+end
+
+-- With a key set, LOKI_AI_PRECONNECT=1 warms the connection at startup
+local preconnect = os.getenv("LOKI_AI_PRECONNECT")
+if preconnect and preconnect ~= "" and preconnect ~= "0" then
+    local api_key = os.getenv("OPENAI_API_KEY")
+    if api_key and api_key ~= "" then M.preconnect() end
+end
+
 -- Export response handler to global scope (required for callback)
 _G.ai_response_handler = response_handler
 
@@ -224,6 +338,8 @@ _G.ai_response_handler = response_handler
 if loki.repl and loki.repl.register then
     if MODE == "editor" then
         loki.repl.register("ai.complete", "Send buffer to AI for completion")
+        loki.repl.register("ai.stream", "Stream an AI completion of the buffer into it")
+        loki.repl.register("ai.suggest", "Stream an AI suggestion at the cursor as ghost text")
         loki.repl.register("ai.explain", "Get code explanation from AI")
     else
         loki.repl.register("ai.complete", "Send text to AI for completion (requires OPENAI_API_KEY)")
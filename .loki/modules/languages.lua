@@ -1,6 +1,11 @@
 -- Language Loading Module - Lazy Loading Implementation
 -- Only loads language definitions when needed (on file open)
 --
+-- Nothing is scanned at startup: init() declares a loader for files no
+-- language matches (loki.declare_language("*", ...)), which scans the
+-- language directories the first time it runs and loads the file for
+-- the extension. Startup costs the same with 5 languages or 500.
+--
 -- Usage:
 --   languages = require("languages")
 --   languages.init()  -- Set up lazy loading (call once at startup)
@@ -17,6 +22,9 @@ local extension_map = {}
 -- Cache of loaded languages (filepath → true)
 local loaded_languages = {}
 
+-- Number of extensions mapped, once the directories were scanned
+local registry_count = nil
+
 -- Configuration
 local config = {
     lang_dir = ".loki/languages",
@@ -123,6 +131,16 @@ local function build_extension_registry(lang_dir)
     return count
 end
 
+-- Scan the language directories, once
+local function ensure_registry()
+    if registry_count then return registry_count end
+    registry_count = build_extension_registry(config.lang_dir)
+    for _, dir in ipairs(config.fallback_dirs) do
+        registry_count = registry_count + build_extension_registry(dir)
+    end
+    return registry_count
+end
+
 -- Load a specific language definition file
 function M.load_file(filepath)
     -- Check if already loaded
@@ -167,6 +185,7 @@ function M.load_for_extension(ext)
     end
 
     -- Check if we have a language for this extension
+    ensure_registry()
     local lang_file = extension_map[ext]
     if not lang_file then
         -- No language definition for this extension
@@ -178,7 +197,9 @@ function M.load_for_extension(ext)
 end
 
 -- Initialize lazy loading system
--- Builds extension registry and loads default/fallback languages
+-- Declares the loader for files no language matches and loads the
+-- default/fallback language. Returns the extensions mapped (0 until a
+-- file needs the directories scanned).
 function M.init(user_config)
     -- Merge user configuration
     if user_config then
@@ -187,17 +208,17 @@ function M.init(user_config)
         end
     end
 
-    -- Build extension registry by scanning language directory
-    local ext_count = build_extension_registry(config.lang_dir)
-
-    -- Also scan fallback directories
-    for _, dir in ipairs(config.fallback_dirs) do
-        ext_count = ext_count + build_extension_registry(dir)
-    end
-
-    -- Status message
-    if ext_count > 0 then
-        status(string.format("Language registry: %d extensions mapped", ext_count))
+    local ext_count = 0
+    if loki.declare_language then
+        -- Scan the directories when a file needs it, not now
+        loki.declare_language("*", function(ext)
+            if ext then M.load_for_extension(ext) end
+        end)
+    else
+        ext_count = ensure_registry()
+        if ext_count > 0 then
+            status(string.format("Language registry: %d extensions mapped", ext_count))
+        end
     end
 
     -- Load default/fallback language immediately (markdown)
@@ -213,7 +234,8 @@ function M.load_all(lang_dir)
     lang_dir = lang_dir or config.lang_dir
 
     -- Build registry first
-    local ext_count = build_extension_registry(lang_dir)
+    local ext_count = lang_dir == config.lang_dir and ensure_registry()
+        or build_extension_registry(lang_dir)
 
     -- Load all registered languages immediately
     local loaded_count = 0
@@ -235,6 +257,7 @@ end
 
 -- Get list of available languages (from extension registry)
 function M.list()
+    ensure_registry()
     local languages = {}
     local seen = {}
 
@@ -252,6 +275,7 @@ end
 
 -- Get extensions supported by a language
 function M.get_extensions(lang_name)
+    ensure_registry()
     local extensions = {}
 
     for ext, filepath in pairs(extension_map) do
@@ -282,6 +306,7 @@ end
 
 -- Get statistics
 function M.stats()
+    ensure_registry()
     local total_extensions = 0
     for _ in pairs(extension_map) do
         total_extensions = total_extensions + 1
@@ -81,6 +81,10 @@ void editor_del_char(editor_ctx_t *ctx);
 /* Insert newline at cursor position */
 void editor_insert_newline(editor_ctx_t *ctx);
 
+/* Insert text (which may hold newlines) at cursor position as one edit,
+ * undone as one; the cursor ends up after it */
+void editor_insert_text(editor_ctx_t *ctx, const char *text, size_t len);
+
 /* ============================================================================
  * File Operations
  * ============================================================================ */
@@ -91,6 +95,10 @@ int editor_save(editor_ctx_t *ctx);
 /* Open a file (returns 0 on success, -1 on error) */
 int editor_open(editor_ctx_t *ctx, char *filename);
 
+/* Open a file read-only a window at a time, as files too large to load
+ * are, whatever its size (returns 0 on success, -1 on error) */
+int editor_open_view(editor_ctx_t *ctx, char *filename);
+
 /* ============================================================================
  * Display and Rendering
  * ============================================================================ */
@@ -0,0 +1,200 @@
+/* ai_context.c - Buffer text for AI requests, as a JSON string
+ *
+ * See ai_context.h for an overview. The cache is an open-addressing
+ * table of escaped rows by the hash of their text (diff_hash(), with the
+ * length checked too); rows are escaped by the JSON builder's escaper.
+ */
+
+#include "ai_context.h"
+#include "diff.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Slots of a new table; it doubles past half full */
+#define AI_CONTEXT_MIN_SLOTS 1024
+
+typedef struct {
+    uint64_t hash;          /* Of the row's text; 0: an empty slot */
+    int len;                /* Of the text */
+    int esc_len;
+    char *esc;              /* Escaped, without the quotes */
+    uint64_t used;          /* Build that last wrote it */
+} AiContextEntry;
+
+struct AiContext {
+    AiContextEntry *slot;
+    size_t nslots;
+    int count;
+    JsonBuilder scratch;    /* A row being escaped */
+    char *out;              /* The last build's string */
+    size_t out_len, out_cap;
+    AiContextStats stats;
+};
+
+static void *ai_alloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+AiContext *ai_context_new(void) {
+    AiContext *ac = calloc(1, sizeof(AiContext));
+    if (!ac) return NULL;
+    ac->slot = calloc(AI_CONTEXT_MIN_SLOTS, sizeof(AiContextEntry));
+    if (!ac->slot) {
+        free(ac);
+        return NULL;
+    }
+    ac->nslots = AI_CONTEXT_MIN_SLOTS;
+    json_builder_init(&ac->scratch);
+    return ac;
+}
+
+void ai_context_free(AiContext *ac) {
+    if (!ac) return;
+    for (size_t i = 0; i < ac->nslots; i++) free(ac->slot[i].esc);
+    free(ac->slot);
+    json_builder_free(&ac->scratch);
+    free(ac->out);
+    free(ac);
+}
+
+AiContextRange ai_context_window(const editor_ctx_t *ctx, int before, int after) {
+    int cy = ctx->view.rowoff + ctx->view.cy;
+    AiContextRange r = { cy - before, cy + after };
+    if (r.first < 0) r.first = 0;
+    if (r.last >= ctx->model.numrows) r.last = ctx->model.numrows - 1;
+    return r;
+}
+
+/* The slot of the entry for text hashing to 'hash' 'len' bytes long, or
+ * the empty slot where it would go */
+static AiContextEntry *lookup(AiContext *ac, uint64_t hash, int len) {
+    size_t mask = ac->nslots - 1, i = (size_t)hash & mask;
+    while (ac->slot[i].hash && (ac->slot[i].hash != hash || ac->slot[i].len != len))
+        i = (i + 1) & mask;
+    return &ac->slot[i];
+}
+
+/* Move the entries to a table of 'nslots' slots, those the last build
+ * did not use dropped if 'sweep' */
+static void rehash(AiContext *ac, size_t nslots, int sweep) {
+    AiContextEntry *old = ac->slot;
+    size_t n = ac->nslots;
+    ac->slot = calloc(nslots, sizeof(AiContextEntry));
+    if (!ac->slot) {
+        perror("Out of memory");
+        exit(1);
+    }
+    ac->nslots = nslots;
+    ac->count = 0;
+    ac->stats.bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!old[i].hash) continue;
+        if (sweep && old[i].used != ac->stats.builds) {
+            free(old[i].esc);
+            continue;
+        }
+        *lookup(ac, old[i].hash, old[i].len) = old[i];
+        ac->count++;
+        ac->stats.bytes += (size_t)old[i].esc_len;
+    }
+    free(old);
+}
+
+/* Room for 'extra' more bytes of output, and a NUL */
+static char *out_room(AiContext *ac, size_t extra) {
+    if (ac->out_len + extra + 1 > ac->out_cap) {
+        size_t cap = ac->out_cap ? ac->out_cap : 4096;
+        while (cap < ac->out_len + extra + 1) cap *= 2;
+        ac->out = ai_alloc(ac->out, cap);
+        ac->out_cap = cap;
+    }
+    return ac->out + ac->out_len;
+}
+
+static void out_append(AiContext *ac, const char *s, size_t len) {
+    memcpy(out_room(ac, len), s, len);
+    ac->out_len += len;
+}
+
+/* Escape 'len' bytes at 's' into the scratch builder; the escaped text
+ * is at scratch.buf + 1, the quotes left out, and this long */
+static size_t escape(AiContext *ac, const char *s, size_t len) {
+    json_builder_reset(&ac->scratch);
+    json_string_len(&ac->scratch, s, len);
+    if (ac->scratch.error) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return ac->scratch.len - 2;
+}
+
+/* Write a row, escaped, from the cache or into it */
+static void write_row(AiContext *ac, const t_erow *row) {
+    uint64_t hash = diff_hash(row->chars, (size_t)row->size);
+    if (hash == 0) hash = 1;
+    AiContextEntry *e = lookup(ac, hash, row->size);
+    if (!e->hash) {
+        size_t n = escape(ac, row->chars, (size_t)row->size);
+        e->hash = hash;
+        e->len = row->size;
+        e->esc_len = (int)n;
+        e->esc = ai_alloc(NULL, n ? n : 1);
+        memcpy(e->esc, ac->scratch.buf + 1, n);
+        ac->count++;
+        ac->stats.bytes += n;
+        ac->stats.escaped++;
+    }
+    e->used = ac->stats.builds;
+    out_append(ac, e->esc, (size_t)e->esc_len);
+    ac->stats.rows++;
+
+    /* Grown here so that 'e' stays valid above */
+    if ((size_t)ac->count * 2 > ac->nslots) rehash(ac, ac->nslots * 2, 0);
+}
+
+const char *ai_context_build(AiContext *ac, const EditorModel *model,
+                             const AiContextRange *ranges, int nranges,
+                             const char *prefix, size_t *len) {
+    ac->stats.builds++;
+    ac->out_len = 0;
+    out_append(ac, "\"", 1);
+    if (prefix && *prefix) {
+        size_t n = escape(ac, prefix, strlen(prefix));
+        out_append(ac, ac->scratch.buf + 1, n);
+    }
+
+    int written = 0, rows = 0;
+    for (int i = 0; i < nranges; i++) {
+        int first = ranges[i].first < 0 ? 0 : ranges[i].first;
+        int last = ranges[i].last >= model->numrows ? model->numrows - 1 : ranges[i].last;
+        if (first > last) continue;
+        if (written++ > 0) out_append(ac, "\\n\\n", 4);
+        out_room(ac, (size_t)(last - first + 1) * 2);
+        for (int r = first; r <= last; r++) {
+            if (r > first) out_append(ac, "\\n", 2);
+            write_row(ac, &model->row[r]);
+        }
+        rows += last - first + 1;
+    }
+    out_append(ac, "\"", 1);
+    ac->out[ac->out_len] = '\0';
+
+    /* Rows no longer in any context go, once they are most of the cache */
+    if (ac->count > 2 * rows + AI_CONTEXT_MIN_SLOTS / 4)
+        rehash(ac, ac->nslots, 1);
+
+    *len = ac->out_len;
+    return ac->out;
+}
+
+void ai_context_get_stats(const AiContext *ac, AiContextStats *stats) {
+    *stats = ac->stats;
+    stats->entries = ac->count;
+}
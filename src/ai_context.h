@@ -0,0 +1,62 @@
+/* ai_context.h - Buffer text for AI requests, as a JSON string
+ *
+ * ai_context_build() writes rows of a buffer as one JSON string literal,
+ * quotes included, ready to drop into a request body: a window of rows
+ * around the cursor (ai_context_window()), or ranges of rows, joined with
+ * newlines, after an optional prefix. Lua gets it as loki.ai_context().
+ *
+ * Each row's escaped form is cached under a hash of its text. A request
+ * after a small edit escapes only the rows that changed and copies the
+ * others; since nothing is keyed by row number, lines inserted above
+ * the window cost nothing either. Entries no build used last time are
+ * dropped once the cache holds more than twice what a build needs. The
+ * output goes to a buffer kept between builds, grown only for a context
+ * larger than any before, so a build is hashing and memcpy.
+ */
+
+#ifndef LOKI_AI_CONTEXT_H
+#define LOKI_AI_CONTEXT_H
+
+#include "internal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rows on each side of the cursor by default, and ranges at most */
+#define AI_CONTEXT_WINDOW 200
+#define AI_CONTEXT_MAX_RANGES 16
+
+typedef struct AiContext AiContext;
+
+/* Rows first..last of a buffer (clamped to it when built) */
+typedef struct {
+    int first, last;
+} AiContextRange;
+
+typedef struct {
+    uint64_t builds;
+    uint64_t rows;          /* Rows written */
+    uint64_t escaped;       /* Of them, not found in the cache */
+    int entries;            /* Rows cached */
+    size_t bytes;           /* Escaped text they hold */
+} AiContextStats;
+
+/* An empty cache. Returns NULL on out of memory. */
+AiContext *ai_context_new(void);
+
+/* Release a cache. Safe on NULL. */
+void ai_context_free(AiContext *ac);
+
+/* Rows 'before' above the cursor's row to 'after' below it, within the
+ * buffer (first > last if it is empty) */
+AiContextRange ai_context_window(const editor_ctx_t *ctx, int before, int after);
+
+/* The rows of 'nranges' ranges of 'model' as a JSON string, 'prefix' (or
+ * NULL) first; the rows of a range are joined with "\n", and ranges with
+ * a blank line. Valid until the next build; *len is its length. */
+const char *ai_context_build(AiContext *ac, const EditorModel *model,
+                             const AiContextRange *ranges, int nranges,
+                             const char *prefix, size_t *len);
+
+void ai_context_get_stats(const AiContext *ac, AiContextStats *stats);
+
+#endif /* LOKI_AI_CONTEXT_H */
@@ -0,0 +1,217 @@
+/* arena.c - Size-class slab allocator for row storage
+ *
+ * See arena.h for an overview. Chunks are bump-allocated; when a chunk
+ * cannot satisfy a request its unused tail is split into free blocks of
+ * the largest classes that fit, so no chunk space is stranded.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "arena.h"
+#include "memstats.h"
+
+/* Smallest size class: 16 bytes, so a free block can hold a list link */
+#define ARENA_MIN_SHIFT 4
+#define ARENA_MAX_SHIFT 12   /* log2(ARENA_MAX_CLASS) */
+#define ARENA_NUM_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+/* Size of one slab chunk, including its header */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;          /* Bytes handed out from data[] */
+    size_t size;          /* Usable bytes in data[] */
+    /* Block storage (data[]) follows the header. */
+} ArenaChunk;
+
+/* Header of a dedicated large block (doubly linked for O(1) free). */
+typedef struct ArenaLarge {
+    struct ArenaLarge *prev, *next;
+    size_t size;
+    size_t pad;           /* Keep the payload 16-byte aligned on LP64 */
+} ArenaLarge;
+
+typedef struct ArenaFree {
+    struct ArenaFree *next;
+} ArenaFree;
+
+struct RowArena {
+    uv_mutex_t lock;
+    ArenaChunk *chunks;                     /* Current chunk first */
+    ArenaFree *free_list[ARENA_NUM_CLASSES];
+    ArenaLarge *large;
+    ArenaStats stats;
+    int refs;                               /* Holders besides the creator */
+    MemTag tag;                             /* Chunks and blocks counted under */
+};
+
+static char *chunk_data(ArenaChunk *chunk) {
+    return (char *)(chunk + 1);
+}
+
+/* Index of the smallest class holding 'need' bytes (need <= max class). */
+static int size_class(size_t need) {
+    int c = 0;
+    while (((size_t)1 << (c + ARENA_MIN_SHIFT)) < need) c++;
+    return c;
+}
+
+static size_t class_size(int c) {
+    return (size_t)1 << (c + ARENA_MIN_SHIFT);
+}
+
+static void push_free(RowArena *arena, int c, void *p) {
+    ArenaFree *f = p;
+    f->next = arena->free_list[c];
+    arena->free_list[c] = f;
+    arena->stats.free_bytes += class_size(c);
+}
+
+/* Split the unused tail of the current chunk into free blocks. */
+static void retire_chunk_tail(RowArena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk) return;
+    for (int c = ARENA_NUM_CLASSES - 1; c >= 0; c--) {
+        while (chunk->size - chunk->used >= class_size(c)) {
+            push_free(arena, c, chunk_data(chunk) + chunk->used);
+            chunk->used += class_size(c);
+        }
+    }
+}
+
+static void *alloc_class(RowArena *arena, int c) {
+    size_t bytes = class_size(c);
+
+    if (arena->free_list[c]) {
+        ArenaFree *f = arena->free_list[c];
+        arena->free_list[c] = f->next;
+        arena->stats.free_bytes -= bytes;
+        arena->stats.used_bytes += bytes;
+        return f;
+    }
+
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < bytes) {
+        ArenaChunk *nchunk = mem_malloc(arena->tag, ARENA_CHUNK_SIZE);
+        if (!nchunk) return NULL;
+        retire_chunk_tail(arena);
+        nchunk->used = 0;
+        nchunk->size = ARENA_CHUNK_SIZE - sizeof(ArenaChunk);
+        nchunk->next = arena->chunks;
+        arena->chunks = nchunk;
+        arena->stats.chunks++;
+        arena->stats.chunk_bytes += ARENA_CHUNK_SIZE;
+        chunk = nchunk;
+    }
+
+    void *p = chunk_data(chunk) + chunk->used;
+    chunk->used += bytes;
+    arena->stats.used_bytes += bytes;
+    return p;
+}
+
+static void *alloc_large(RowArena *arena, size_t need) {
+    ArenaLarge *blk = mem_malloc(arena->tag, sizeof(ArenaLarge) + need);
+    if (!blk) return NULL;
+    blk->size = need;
+    blk->prev = NULL;
+    blk->next = arena->large;
+    if (arena->large) arena->large->prev = blk;
+    arena->large = blk;
+    arena->stats.large_blocks++;
+    arena->stats.large_bytes += need;
+    return blk + 1;
+}
+
+RowArena *arena_create(void) {
+    RowArena *arena = calloc(1, sizeof(*arena));
+    if (!arena) return NULL;
+    if (uv_mutex_init(&arena->lock) != 0) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void arena_set_tag(RowArena *arena, MemTag tag) {
+    arena->tag = tag;
+}
+
+void arena_retain(RowArena *arena) {
+    uv_mutex_lock(&arena->lock);
+    arena->refs++;
+    uv_mutex_unlock(&arena->lock);
+}
+
+void arena_destroy(RowArena *arena) {
+    if (!arena) return;
+    uv_mutex_lock(&arena->lock);
+    int held = arena->refs-- > 0;
+    uv_mutex_unlock(&arena->lock);
+    if (held) return;
+
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        mem_free(arena->tag, chunk);
+        chunk = next;
+    }
+    ArenaLarge *blk = arena->large;
+    while (blk) {
+        ArenaLarge *next = blk->next;
+        mem_free(arena->tag, blk);
+        blk = next;
+    }
+    uv_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+void *arena_alloc(RowArena *arena, size_t need, int *cap) {
+    void *p;
+
+    if (need == 0) need = 1;
+    uv_mutex_lock(&arena->lock);
+    if (need <= ARENA_MAX_CLASS) {
+        int c = size_class(need);
+        p = alloc_class(arena, c);
+        if (p) *cap = (int)class_size(c);
+    } else {
+        p = alloc_large(arena, need);
+        if (p) *cap = (int)need;
+    }
+    uv_mutex_unlock(&arena->lock);
+    return p;
+}
+
+void arena_free(RowArena *arena, void *p, int cap) {
+    if (!p) return;
+
+    uv_mutex_lock(&arena->lock);
+    if ((size_t)cap <= ARENA_MAX_CLASS) {
+        int c = size_class((size_t)cap);
+        arena->stats.used_bytes -= class_size(c);
+        push_free(arena, c, p);
+    } else {
+        ArenaLarge *blk = (ArenaLarge *)p - 1;
+        if (blk->prev) blk->prev->next = blk->next;
+        else arena->large = blk->next;
+        if (blk->next) blk->next->prev = blk->prev;
+        arena->stats.large_blocks--;
+        arena->stats.large_bytes -= blk->size;
+        mem_free(arena->tag, blk);
+    }
+    uv_mutex_unlock(&arena->lock);
+}
+
+void arena_get_stats(RowArena *arena, ArenaStats *stats) {
+    if (!arena) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    uv_mutex_lock(&arena->lock);
+    *stats = arena->stats;
+    uv_mutex_unlock(&arena->lock);
+}
@@ -0,0 +1,69 @@
+/* arena.h - Size-class slab allocator for row storage
+ *
+ * Each EditorModel owns one RowArena from which the chars, render and hl
+ * buffers of its rows are carved, instead of giving every row three
+ * independent heap blocks:
+ *
+ * - Requests up to ARENA_MAX_CLASS bytes are rounded up to a power-of-two
+ *   size class and served from 64KB chunks. Freed blocks go onto a
+ *   per-class free list and are reused by the next request of that class,
+ *   so long editing sessions do not fragment the heap, and the rounding
+ *   wastes at most half of each block.
+ * - Larger requests get a dedicated heap block that is still linked into
+ *   the arena.
+ *
+ * arena_destroy() releases everything in one pass over the chunk list,
+ * without visiting individual rows. Blocks that must outlive the rows
+ * (row contents shared with the undo history) hold the arena with
+ * arena_retain(), and it is released when the last holder lets go. All
+ * calls are serialized by an internal mutex, so workers may allocate
+ * from the same arena while loading a file in parallel.
+ */
+
+#ifndef LOKI_ARENA_H
+#define LOKI_ARENA_H
+
+#include <stddef.h>
+#include "memstats.h"
+
+/* Largest request served from a size class (larger ones are dedicated) */
+#define ARENA_MAX_CLASS 4096
+
+typedef struct RowArena RowArena;
+
+/* Memory usage snapshot returned by arena_get_stats(). */
+typedef struct ArenaStats {
+    size_t chunks;        /* Number of slab chunks */
+    size_t chunk_bytes;   /* Bytes held in slab chunks */
+    size_t used_bytes;    /* Bytes in live size-class blocks */
+    size_t free_bytes;    /* Bytes on the free lists, ready for reuse */
+    size_t large_blocks;  /* Number of dedicated large blocks */
+    size_t large_bytes;   /* Bytes in dedicated large blocks */
+} ArenaStats;
+
+/* Create an empty arena. Returns NULL on out of memory. */
+RowArena *arena_create(void);
+
+/* Release the arena and every block allocated from it, or drop one
+ * arena_retain() if any are left. Safe on NULL. */
+void arena_destroy(RowArena *arena);
+
+/* Count the arena's memory under 'tag' (MEM_TAG_CORE by default); set
+ * it before anything is allocated. */
+void arena_set_tag(RowArena *arena, MemTag tag);
+
+/* Hold the arena for one more arena_destroy(). */
+void arena_retain(RowArena *arena);
+
+/* Allocate at least 'need' bytes (need <= INT_MAX). *cap receives the
+ * usable size of the block, which must be passed back to arena_free().
+ * Returns NULL on out of memory. */
+void *arena_alloc(RowArena *arena, size_t need, int *cap);
+
+/* Return a block obtained from arena_alloc() with its capacity. */
+void arena_free(RowArena *arena, void *p, int cap);
+
+/* Fill 'stats' with the arena's current memory usage. */
+void arena_get_stats(RowArena *arena, ArenaStats *stats);
+
+#endif /* LOKI_ARENA_H */
@@ -1,34 +1,115 @@
 /* async_queue.c - Generic async event queue implementation
  *
- * Thread-safe ring buffer with libuv cross-thread notification.
+ * Lock-free multi-producer, single-consumer rings with libuv cross-thread
+ * notification, one per priority lane. Every slot carries a sequence
+ * number (after Dmitry Vyukov's bounded queue): a slot at position p is
+ * free for the producer that claims p while its sequence is p, and holds
+ * an event for the consumer once it is p + 1; the consumer hands it back
+ * for position p + capacity. Producers claim positions with a
+ * compare-and-swap on the tail, so they only contend on that word, and
+ * the head is the consumer's alone. Each sits on a cache line of its own.
+ *
+ * An event goes to the lane its type's handler was set for (see
+ * async_queue_set_handler_lane()).
+ * The consumer takes from the highest lane that has events, and
+ * async_queue_dispatch() gives every lane with events at least one slice
+ * before the time budget stops it, so low lanes wait but never starve.
+ *
+ * The rings do not grow: a push into a full one does what its type's
+ * policy says. ASYNC_POLICY_COALESCE events that do not fit wait in one
+ * slot per type beside the rings, under a lock only that path takes, and
+ * come out once their lane's ring is empty; a newer one of the type
+ * replaces the one waiting, so a stream of them holds at most one extra
+ * event.
+ *
+ * Payloads come from per-size-class free lists under a lock each, so a
+ * producer streaming events of similar sizes reuses the blocks the
+ * consumer released rather than going to malloc for every one. A block
+ * carries its class and a reference count ahead of the data.
+ *
+ * Dispatch times every event: push to dispatch, and its handler, into
+ * histograms per type with buckets a power of two wide split in 8 (so
+ * within 12.5%, as HDR histograms). They belong to the consumer, so take
+ * no atomics.
+ *
+ * A batch push claims as many positions as it has room for with one
+ * compare-and-swap: the consumer frees slots in order, so when the last
+ * of them is free for this lap all of them are.
  */
 
 #define _POSIX_C_SOURCE 200809L
 
 #include "async_queue.h"
-#include <pthread.h>
 #include <uv.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 /* ============================================================================
  * Queue Structure
  * ============================================================================ */
 
+#define ASYNC_CACHE_LINE 64
+
+typedef struct AsyncSlot {
+    _Atomic uint32_t seq;           /* See above */
+    AsyncEvent event;
+} AsyncSlot;
+
+/* Log-linear histogram: values below 16 exactly, then 8 buckets per power
+ * of two */
+#define HIST_BUCKETS 320
+
+typedef struct AsyncHist {
+    uint64_t count, sum, max;
+    uint32_t buckets[HIST_BUCKETS];
+} AsyncHist;
+
+typedef struct AsyncTypeTiming {
+    AsyncHist latency;              /* Push to dispatch */
+    AsyncHist handler;              /* Handler run time */
+} AsyncTypeTiming;
+
+/* A lane's ring; positions count up and wrap, slots are pos & mask */
+typedef struct AsyncLane {
+    AsyncSlot *slots;
+    char pad0[ASYNC_CACHE_LINE];
+    _Atomic uint32_t tail;          /* Next position producers claim */
+    char pad1[ASYNC_CACHE_LINE - sizeof(uint32_t)];
+    _Atomic uint32_t head;          /* Next position the consumer reads */
+    char pad2[ASYNC_CACHE_LINE - sizeof(uint32_t)];
+} AsyncLane;
+
 struct AsyncEventQueue {
-    /* Ring buffer */
-    AsyncEvent events[ASYNC_QUEUE_SIZE];
-    _Atomic uint32_t head;          /* Consumer reads from here */
-    _Atomic uint32_t tail;          /* Producer writes here */
+    AsyncLane lanes[ASYNC_LANE_COUNT];
+    uint32_t capacity, mask;        /* Of each lane */
+
+    /* Lanes and overflow policies of types, and ASYNC_POLICY_COALESCE
+     * events held aside */
+    _Atomic int lane[ASYNC_EVENT_TYPE_COUNT];
+    _Atomic int policy[ASYNC_EVENT_TYPE_COUNT];
+    uv_mutex_t held_lock;
+    AsyncEvent held[ASYNC_EVENT_TYPE_COUNT];
+    uint32_t held_types;            /* Bit per type held, under held_lock */
+    _Atomic int nheld;
+
+    /* Counters (see AsyncQueueStats) */
+    _Atomic uint32_t high_water;
+    _Atomic uint64_t pushed, rejected, dropped, coalesced, blocked;
 
     /* Cross-thread notification */
     uv_async_t wakeup;
-    uv_mutex_t mutex;
+    uv_thread_t consumer;           /* Thread that initialized the queue */
 
     /* Handler dispatch table */
     AsyncEventHandler handlers[ASYNC_MAX_HANDLERS];
 
+    /* Dispatch timings, and events queued when each dispatch began
+     * (consumer only) */
+    AsyncTypeTiming timing[ASYNC_EVENT_TYPE_COUNT];
+    AsyncHist depth;
+
     /* Initialization state */
     int initialized;
 
@@ -39,6 +120,42 @@ struct AsyncEventQueue {
 /* Global queue instance */
 static AsyncEventQueue g_queue;
 
+/* Names given to event types (see async_event_set_type_name()) */
+static const char *g_type_names[ASYNC_EVENT_TYPE_COUNT];
+
+/* Payload pool: classes of 64 << (2 * n) bytes, free blocks kept up to a
+ * count per class */
+#define PAYLOAD_CLASSES 5
+#define PAYLOAD_MIN_SHIFT 6
+#define PAYLOAD_KEEP 64
+
+typedef union PayloadHeader {
+    struct {
+        _Atomic int refs;
+        int size_class;             /* -1: from malloc, not pooled */
+        union PayloadHeader *next;  /* In a free list */
+    } h;
+    long double align;              /* Data after it aligned for anything */
+} PayloadHeader;
+
+static struct {
+    uv_mutex_t lock;
+    PayloadHeader *free;
+    int nfree;
+} g_payloads[PAYLOAD_CLASSES];
+static uv_once_t g_payloads_once = UV_ONCE_INIT;
+static _Atomic uint64_t g_payloads_reused, g_payloads_allocated;
+
+/* The pool's locks, made on first use: payloads may come before the queue */
+static void payloads_init(void) {
+    for (int c = 0; c < PAYLOAD_CLASSES; c++) {
+        if (uv_mutex_init(&g_payloads[c].lock) != 0) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+}
+
 /* ============================================================================
  * Internal Helpers
  * ============================================================================ */
@@ -53,39 +170,88 @@ static void on_queue_wakeup(uv_async_t *handle) {
     /* The wakeup signal itself is sufficient - main thread will poll queue */
 }
 
+static void count(_Atomic uint64_t *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static int valid_type(int type) {
+    return type > ASYNC_EVENT_NONE && type < ASYNC_EVENT_TYPE_COUNT;
+}
+
+/* The lane events of a type go to */
+static AsyncLane *lane_of(AsyncEventQueue *queue, int type) {
+    int lane = valid_type(type)
+        ? atomic_load_explicit(&queue->lane[type], memory_order_relaxed)
+        : ASYNC_LANE_NORMAL;
+    return &queue->lanes[lane];
+}
+
+static void free_lanes(AsyncEventQueue *queue) {
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        free(queue->lanes[l].slots);
+        queue->lanes[l].slots = NULL;
+    }
+}
+
 /* ============================================================================
  * Lifecycle
  * ============================================================================ */
 
 int async_queue_init(void) {
+    return async_queue_init_sized(ASYNC_QUEUE_SIZE);
+}
+
+int async_queue_init_sized(uint32_t capacity) {
+    uint32_t size = 2;
+    while (size < capacity && size < ASYNC_QUEUE_MAX_SIZE) size <<= 1;
+
     if (g_queue.initialized) {
-        return 0;  /* Already initialized */
+        return g_queue.capacity == size ? 0 : -1;  /* Already initialized */
     }
 
     memset(&g_queue, 0, sizeof(g_queue));
+    g_queue.capacity = size;
+    g_queue.mask = size - 1;
+
+    /* Initialize positions, and each slot free for the first lap */
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        AsyncLane *lane = &g_queue.lanes[l];
+        lane->slots = calloc(size, sizeof(AsyncSlot));
+        if (!lane->slots) {
+            free_lanes(&g_queue);
+            return -1;
+        }
+        atomic_store(&lane->head, 0);
+        atomic_store(&lane->tail, 0);
+        for (uint32_t i = 0; i < size; i++) {
+            atomic_store(&lane->slots[i].seq, i);
+        }
+    }
+    for (int type = 0; type < ASYNC_EVENT_TYPE_COUNT; type++) {
+        atomic_store(&g_queue.lane[type], ASYNC_LANE_NORMAL);
+    }
 
-    /* Initialize atomic counters */
-    atomic_store(&g_queue.head, 0);
-    atomic_store(&g_queue.tail, 0);
-
-    /* Initialize mutex */
-    if (uv_mutex_init(&g_queue.mutex) != 0) {
+    if (uv_mutex_init(&g_queue.held_lock) != 0) {
+        free_lanes(&g_queue);
         return -1;
     }
 
     /* Get or create default loop */
     g_queue.loop = uv_default_loop();
     if (!g_queue.loop) {
-        uv_mutex_destroy(&g_queue.mutex);
+        uv_mutex_destroy(&g_queue.held_lock);
+        free_lanes(&g_queue);
         return -1;
     }
 
     /* Initialize async handle for cross-thread notification */
     if (uv_async_init(g_queue.loop, &g_queue.wakeup, on_queue_wakeup) != 0) {
-        uv_mutex_destroy(&g_queue.mutex);
+        uv_mutex_destroy(&g_queue.held_lock);
+        free_lanes(&g_queue);
         return -1;
     }
 
+    g_queue.consumer = uv_thread_self();
     g_queue.initialized = 1;
 
     return 0;
@@ -108,7 +274,23 @@ void async_queue_cleanup(void) {
     /* Run loop once to process close callbacks */
     uv_run(g_queue.loop, UV_RUN_NOWAIT);
 
-    uv_mutex_destroy(&g_queue.mutex);
+    uv_mutex_destroy(&g_queue.held_lock);
+    free_lanes(&g_queue);
+
+    /* Give the pool's free blocks back */
+    uv_once(&g_payloads_once, payloads_init);
+    for (int c = 0; c < PAYLOAD_CLASSES; c++) {
+        uv_mutex_lock(&g_payloads[c].lock);
+        while (g_payloads[c].free) {
+            PayloadHeader *block = g_payloads[c].free;
+            g_payloads[c].free = block->h.next;
+            free(block);
+        }
+        g_payloads[c].nfree = 0;
+        uv_mutex_unlock(&g_payloads[c].lock);
+    }
+    atomic_store(&g_payloads_reused, 0);
+    atomic_store(&g_payloads_allocated, 0);
 
     g_queue.initialized = 0;
 }
@@ -121,39 +303,229 @@ AsyncEventQueue *async_queue_global(void) {
  * Producer API (Thread-Safe)
  * ============================================================================ */
 
+/* Record a lane's depth with positions up to 'end' claimed */
+static void note_depth(AsyncEventQueue *queue, AsyncLane *lane, uint32_t end) {
+    uint32_t depth = end - atomic_load_explicit(&lane->head, memory_order_relaxed);
+    uint32_t high = atomic_load_explicit(&queue->high_water, memory_order_relaxed);
+    while (depth > high && depth <= queue->capacity &&
+           !atomic_compare_exchange_weak_explicit(&queue->high_water, &high, depth,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {}
+}
+
+/* Put an event in its lane. Returns 0, or -1 if that is full. */
+static int ring_push(AsyncEventQueue *queue, const AsyncEvent *event) {
+    AsyncLane *lane = lane_of(queue, event->type);
+
+    /* Claim the tail position, if its slot is free */
+    uint32_t pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+    AsyncSlot *slot;
+    for (;;) {
+        slot = &lane->slots[pos & queue->mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&lane->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;  /* Lane full: the slot holds the last lap's event */
+        } else {
+            pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+        }
+    }
+
+    /* Copy event into the slot, then publish it */
+    slot->event = *event;
+
+    /* Set timestamp if not already set */
+    if (slot->event.timestamp == 0) {
+        slot->event.timestamp = (int64_t)uv_hrtime();
+    }
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    note_depth(queue, lane, pos + 1);
+    return 0;
+}
+
+/* Put up to 'n' events, all of one lane, in it with one claim. Returns
+ * how many. */
+static uint32_t ring_push_n(AsyncEventQueue *queue, AsyncLane *lane,
+                            const AsyncEvent *events, uint32_t n) {
+    uint32_t pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+    uint32_t k;
+    for (;;) {
+        int32_t used = (int32_t)(pos - atomic_load_explicit(&lane->head,
+                                                            memory_order_acquire));
+        if (used < 0) used = 0;     /* 'pos' is stale */
+        if ((uint32_t)used >= queue->capacity) {
+            AsyncSlot *slot = &lane->slots[pos & queue->mask];
+            if ((int32_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos) < 0)
+                return 0;           /* Lane full */
+            pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+            continue;
+        }
+        k = queue->capacity - (uint32_t)used;
+        if (k > n) k = n;
+        AsyncSlot *last = &lane->slots[(pos + k - 1) & queue->mask];
+        if (atomic_load_explicit(&last->seq, memory_order_acquire) != pos + k - 1) {
+            pos = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&lane->tail, &pos, pos + k,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+    }
+
+    int64_t now = (int64_t)uv_hrtime();
+    for (uint32_t i = 0; i < k; i++) {
+        AsyncSlot *slot = &lane->slots[(pos + i) & queue->mask];
+        slot->event = events[i];
+        if (slot->event.timestamp == 0) slot->event.timestamp = now;
+        atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+    }
+    note_depth(queue, lane, pos + k);
+    return k;
+}
+
+/* Hold a coalescing event aside, in place of the one of its type held
+ * already. With 'ring' set, put it in its lane instead if one of its type
+ * is not held and there is room. */
+static void hold_event(AsyncEventQueue *queue, const AsyncEvent *event, int ring) {
+    uint32_t bit = 1u << event->type;
+    uv_mutex_lock(&queue->held_lock);
+    if (ring && !(queue->held_types & bit) && ring_push(queue, event) == 0) {
+        uv_mutex_unlock(&queue->held_lock);
+        return;
+    }
+    AsyncEvent *held = &queue->held[event->type];
+    if (queue->held_types & bit) {
+        async_event_cleanup(held);
+        count(&queue->coalesced);
+    } else {
+        queue->held_types |= bit;
+        atomic_fetch_add(&queue->nheld, 1);
+    }
+    *held = *event;
+    if (held->timestamp == 0) {
+        held->timestamp = (int64_t)uv_hrtime();
+    }
+    uv_mutex_unlock(&queue->held_lock);
+}
+
+/* Push once the consumer makes room. Returns -1 on the consumer's own
+ * thread, which would wait for itself. */
+static int push_waiting(AsyncEventQueue *queue, const AsyncEvent *event) {
+    uv_thread_t self = uv_thread_self();
+    if (uv_thread_equal(&queue->consumer, &self)) {
+        return -1;
+    }
+    count(&queue->blocked);
+    uv_async_send(&queue->wakeup);
+    while (ring_push(queue, event) != 0) {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
 int async_queue_push(AsyncEventQueue *queue, const AsyncEvent *event) {
     queue = resolve_queue(queue);
     if (!queue || !event) {
         return -1;
     }
 
-    uv_mutex_lock(&queue->mutex);
+    int policy = valid_type(event->type)
+        ? atomic_load_explicit(&queue->policy[event->type], memory_order_relaxed)
+        : ASYNC_POLICY_FAIL;
+
+    if (policy == ASYNC_POLICY_COALESCE && atomic_load(&queue->nheld) > 0) {
+        /* One of its type may be held: it goes after that one */
+        hold_event(queue, event, 1);
+    } else if (ring_push(queue, event) != 0) {
+        switch (policy) {
+        case ASYNC_POLICY_COALESCE:
+            hold_event(queue, event, 1);
+            break;
+        case ASYNC_POLICY_DROP:
+            count(&queue->dropped);
+            return 1;
+        case ASYNC_POLICY_BLOCK:
+            if (push_waiting(queue, event) == 0) break;
+            count(&queue->rejected);
+            return -1;
+        default:
+            count(&queue->rejected);
+            return -1;
+        }
+    }
+    count(&queue->pushed);
 
-    uint32_t tail = atomic_load(&queue->tail);
-    uint32_t next = (tail + 1) & ASYNC_QUEUE_SIZE_MASK;
+    /* Wake main thread */
+    uv_async_send(&queue->wakeup);
+
+    return 0;
+}
 
-    if (next == atomic_load(&queue->head)) {
-        /* Queue full */
-        uv_mutex_unlock(&queue->mutex);
+int async_queue_push_batch(AsyncEventQueue *queue, const AsyncEvent *events, int n) {
+    queue = resolve_queue(queue);
+    if (!queue || (!events && n > 0) || n < 0) {
         return -1;
     }
 
-    /* Copy event into queue */
-    queue->events[tail] = *event;
-
-    /* Set timestamp if not already set */
-    if (queue->events[tail].timestamp == 0) {
-        queue->events[tail].timestamp = (int64_t)uv_hrtime();
+    /* Events held aside come out after their lane: with any held, a batch
+     * event of their type has to go after them */
+    int done = 0;
+    if (atomic_load(&queue->nheld) == 0) {
+        /* Each run of events for one lane with one claim */
+        while (done < n) {
+            AsyncLane *lane = lane_of(queue, events[done].type);
+            int run = 1;
+            while (done + run < n && lane_of(queue, events[done + run].type) == lane) {
+                run++;
+            }
+            int k = (int)ring_push_n(queue, lane, events + done, (uint32_t)run);
+            done += k;
+            if (k < run) break;
+        }
+        if (done > 0) {
+            atomic_fetch_add_explicit(&queue->pushed, (uint64_t)done, memory_order_relaxed);
+            uv_async_send(&queue->wakeup);
+        }
+    }
+    while (done < n && async_queue_push(queue, &events[done]) >= 0) {
+        done++;
     }
+    return done;
+}
 
-    atomic_store(&queue->tail, next);
+void async_queue_set_policy(AsyncEventQueue *queue, AsyncEventType type, AsyncPushPolicy policy) {
+    queue = resolve_queue(queue);
+    if (!queue || !valid_type(type)) {
+        return;
+    }
 
-    uv_mutex_unlock(&queue->mutex);
+    atomic_store(&queue->policy[type], (int)policy);
+}
 
-    /* Wake main thread */
-    uv_async_send(&queue->wakeup);
+void async_queue_get_stats(AsyncEventQueue *queue, AsyncQueueStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    queue = resolve_queue(queue);
+    if (!queue) {
+        return;
+    }
 
-    return 0;
+    stats->capacity = queue->capacity;
+    stats->high_water = atomic_load(&queue->high_water);
+    stats->pushed = atomic_load(&queue->pushed);
+    stats->rejected = atomic_load(&queue->rejected);
+    stats->dropped = atomic_load(&queue->dropped);
+    stats->coalesced = atomic_load(&queue->coalesced);
+    stats->blocked = atomic_load(&queue->blocked);
+    stats->payloads_reused = atomic_load(&g_payloads_reused);
+    stats->payloads_allocated = atomic_load(&g_payloads_allocated);
 }
 
 int async_queue_push_timer(AsyncEventQueue *queue, int timer_id, void *userdata) {
@@ -185,11 +557,12 @@ int async_queue_push_custom(AsyncEventQueue *queue, const char *tag, const void
 
     /* Copy data to heap if provided */
     if (data && len > 0) {
-        event.heap_data = malloc(len);
+        event.heap_data = async_payload_alloc(len);
         if (!event.heap_data) {
             return -1;
         }
         memcpy(event.heap_data, data, len);
+        event.flags = ASYNC_FLAG_PAYLOAD;
         event.data.custom.data = event.heap_data;
         event.data.custom.len = len;
     } else {
@@ -199,49 +572,115 @@ int async_queue_push_custom(AsyncEventQueue *queue, const char *tag, const void
 
     int result = async_queue_push(queue, &event);
     if (result != 0 && event.heap_data) {
-        free(event.heap_data);
+        async_payload_release(event.heap_data);
     }
     return result;
 }
 
+int async_queue_push_payload(AsyncEventQueue *queue, const char *tag, void *payload, size_t len) {
+    AsyncEvent event = {
+        .type = ASYNC_EVENT_CUSTOM,
+        .flags = payload ? ASYNC_FLAG_PAYLOAD : 0,
+        .timestamp = 0,
+        .heap_data = payload
+    };
+
+    if (tag) {
+        strncpy(event.data.custom.tag, tag, ASYNC_CUSTOM_TAG_SIZE - 1);
+        event.data.custom.tag[ASYNC_CUSTOM_TAG_SIZE - 1] = '\0';
+    } else {
+        event.data.custom.tag[0] = '\0';
+    }
+    event.data.custom.data = payload;
+    event.data.custom.len = payload ? len : 0;
+
+    return async_queue_push(queue, &event);
+}
+
 /* ============================================================================
  * Consumer API (Main Thread Only)
  * ============================================================================ */
 
-int async_queue_peek(AsyncEventQueue *queue, AsyncEvent *event) {
-    queue = resolve_queue(queue);
-    if (!queue || !event) {
+/* The slot at a lane's head if it holds an event, or NULL */
+static AsyncSlot *head_slot(AsyncEventQueue *queue, AsyncLane *lane, uint32_t *pos) {
+    *pos = atomic_load_explicit(&lane->head, memory_order_relaxed);
+    AsyncSlot *slot = &lane->slots[*pos & queue->mask];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    return seq == *pos + 1 ? slot : NULL;
+}
+
+/* Give a lane's head slot back to producers, for the next lap */
+static void release_head(AsyncEventQueue *queue, AsyncLane *lane, AsyncSlot *slot,
+                         uint32_t pos) {
+    atomic_store_explicit(&slot->seq, pos + queue->capacity, memory_order_release);
+    atomic_store_explicit(&lane->head, pos + 1, memory_order_release);
+}
+
+/* Copy out the first event held aside for a lane, removing it if 'take'
+ * is set. Returns 0, or 1 if none is held. */
+static int take_held(AsyncEventQueue *queue, AsyncLane *lane, AsyncEvent *event,
+                     int take) {
+    if (atomic_load(&queue->nheld) == 0) {
         return 1;
     }
+    uv_mutex_lock(&queue->held_lock);
+    int found = 1;
+    for (int type = 0; type < ASYNC_EVENT_TYPE_COUNT; type++) {
+        if (!(queue->held_types & (1u << type)) || lane_of(queue, type) != lane) continue;
+        *event = queue->held[type];
+        if (take) {
+            queue->held_types &= ~(1u << type);
+            atomic_fetch_sub(&queue->nheld, 1);
+        }
+        found = 0;
+        break;
+    }
+    uv_mutex_unlock(&queue->held_lock);
+    return found;
+}
 
-    uint32_t head = atomic_load(&queue->head);
-    uint32_t tail = atomic_load(&queue->tail);
-
-    if (head == tail) {
-        return 1;  /* Empty */
+/* Take (or with 'take' unset, copy) the next event of a lane. Returns 0,
+ * or 1 if it has none. */
+static int lane_next(AsyncEventQueue *queue, AsyncLane *lane, AsyncEvent *event,
+                     int take) {
+    uint32_t pos;
+    AsyncSlot *slot = head_slot(queue, lane, &pos);
+    if (!slot) {
+        /* Empty, or the next event is still being written */
+        return take_held(queue, lane, event, take);
     }
 
-    *event = queue->events[head];
+    *event = slot->event;
+    if (take) release_head(queue, lane, slot, pos);
     return 0;
 }
 
-int async_queue_poll(AsyncEventQueue *queue, AsyncEvent *event) {
+/* The next event, from the highest lane with one */
+static int queue_next(AsyncEventQueue *queue, AsyncEvent *event, int take) {
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        if (lane_next(queue, &queue->lanes[l], event, take) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int async_queue_peek(AsyncEventQueue *queue, AsyncEvent *event) {
     queue = resolve_queue(queue);
     if (!queue || !event) {
         return 1;
     }
 
-    uint32_t head = atomic_load(&queue->head);
-    uint32_t tail = atomic_load(&queue->tail);
+    return queue_next(queue, event, 0);
+}
 
-    if (head == tail) {
-        return 1;  /* Empty */
+int async_queue_poll(AsyncEventQueue *queue, AsyncEvent *event) {
+    queue = resolve_queue(queue);
+    if (!queue || !event) {
+        return 1;
     }
 
-    *event = queue->events[head];
-    atomic_store(&queue->head, (head + 1) & ASYNC_QUEUE_SIZE_MASK);
-
-    return 0;
+    return queue_next(queue, event, 1);
 }
 
 void async_queue_pop(AsyncEventQueue *queue) {
@@ -250,17 +689,11 @@ void async_queue_pop(AsyncEventQueue *queue) {
         return;
     }
 
-    uint32_t head = atomic_load(&queue->head);
-    uint32_t tail = atomic_load(&queue->tail);
-
-    if (head == tail) {
-        return;  /* Empty */
-    }
-
     /* Free any heap data */
-    async_event_cleanup(&queue->events[head]);
-
-    atomic_store(&queue->head, (head + 1) & ASYNC_QUEUE_SIZE_MASK);
+    AsyncEvent event;
+    if (queue_next(queue, &event, 1) == 0) {
+        async_event_cleanup(&event);
+    }
 }
 
 int async_queue_is_empty(AsyncEventQueue *queue) {
@@ -269,7 +702,26 @@ int async_queue_is_empty(AsyncEventQueue *queue) {
         return 1;
     }
 
-    return atomic_load(&queue->head) == atomic_load(&queue->tail) ? 1 : 0;
+    if (atomic_load(&queue->nheld) > 0) {
+        return 0;
+    }
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        uint32_t pos;
+        if (head_slot(queue, &queue->lanes[l], &pos)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int async_queue_lane_is_empty(AsyncEventQueue *queue, AsyncLaneId lane) {
+    queue = resolve_queue(queue);
+    if (!queue || lane < 0 || lane >= ASYNC_LANE_COUNT) {
+        return 1;
+    }
+
+    AsyncEvent event;
+    return lane_next(queue, &queue->lanes[lane], &event, 0);
 }
 
 int async_queue_count(AsyncEventQueue *queue) {
@@ -278,33 +730,180 @@ int async_queue_count(AsyncEventQueue *queue) {
         return 0;
     }
 
-    uint32_t head = atomic_load(&queue->head);
-    uint32_t tail = atomic_load(&queue->tail);
-
-    return (int)((tail - head) & ASYNC_QUEUE_SIZE_MASK);
+    /* Claimed positions, some of which may still be being written */
+    int n = atomic_load(&queue->nheld);
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        AsyncLane *lane = &queue->lanes[l];
+        n += (int)(atomic_load(&lane->tail) - atomic_load(&lane->head));
+    }
+    return n;
 }
 
 int async_queue_dispatch_all(AsyncEventQueue *queue, void *ctx) {
+    return async_queue_dispatch(queue, ctx, 0);
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < 16) return (int)v;
+    int e = 63;
+    while (!(v >> e)) e--;
+    int i = 16 + (e - 4) * 8 + (int)((v >> (e - 3)) & 7);
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* Smallest value of a bucket */
+static uint64_t hist_low(int i) {
+    if (i < 16) return (uint64_t)i;
+    int e = (i - 16) / 8 + 4;
+    return (uint64_t)(8 + (i - 16) % 8) << (e - 3);
+}
+
+static void hist_record(AsyncHist *hist, uint64_t v) {
+    hist->count++;
+    hist->sum += v;
+    if (v > hist->max) hist->max = v;
+    hist->buckets[hist_bucket(v)]++;
+}
+
+/* Value below which a fraction 'q' of the values fall, as the middle of
+ * its bucket (no more than the largest value) */
+static uint64_t hist_quantile(const AsyncHist *hist, double q) {
+    uint64_t want = (uint64_t)(q * (double)hist->count + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= want) {
+            uint64_t mid = i < 16 ? hist_low(i)
+                                  : hist_low(i) + (hist_low(i + 1) - hist_low(i)) / 2;
+            return mid < hist->max ? mid : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void hist_summary(const AsyncHist *hist, AsyncHistStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (hist->count == 0) {
+        return;
+    }
+    stats->count = hist->count;
+    stats->mean = hist->sum / hist->count;
+    stats->p50 = hist_quantile(hist, 0.50);
+    stats->p90 = hist_quantile(hist, 0.90);
+    stats->p99 = hist_quantile(hist, 0.99);
+    stats->max = hist->max;
+}
+
+int async_queue_get_type_stats(AsyncEventQueue *queue, AsyncEventType type,
+                               AsyncHistStats *latency, AsyncHistStats *handler) {
+    queue = resolve_queue(queue);
+    if (!queue || !valid_type(type) || queue->timing[type].latency.count == 0) {
+        return -1;
+    }
+
+    if (latency) hist_summary(&queue->timing[type].latency, latency);
+    if (handler) hist_summary(&queue->timing[type].handler, handler);
+    return 0;
+}
+
+void async_queue_get_depth_stats(AsyncEventQueue *queue, AsyncHistStats *depth) {
     queue = resolve_queue(queue);
     if (!queue) {
-        return 0;
+        memset(depth, 0, sizeof(*depth));
+        return;
     }
 
-    int count = 0;
-    AsyncEvent event;
+    hist_summary(&queue->depth, depth);
+}
+
+void async_queue_reset_timing(AsyncEventQueue *queue) {
+    queue = resolve_queue(queue);
+    if (!queue) {
+        return;
+    }
 
-    while (async_queue_poll(queue, &event) == 0) {
-        if (event.type > ASYNC_EVENT_NONE && event.type < ASYNC_MAX_HANDLERS) {
-            AsyncEventHandler handler = queue->handlers[event.type];
+    memset(queue->timing, 0, sizeof(queue->timing));
+    memset(&queue->depth, 0, sizeof(queue->depth));
+}
+
+/* Drop the events of a slice that a later one of the slice supersedes */
+static void collapse_slice(AsyncEventQueue *queue, AsyncEvent *slice, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!slice[i].coalesce_key) continue;
+        for (int j = i + 1; j < n; j++) {
+            if (slice[j].type == slice[i].type &&
+                slice[j].coalesce_key == slice[i].coalesce_key) {
+                async_event_cleanup(&slice[i]);
+                slice[i].type = ASYNC_EVENT_NONE;
+                count(&queue->coalesced);
+                break;
+            }
+        }
+    }
+}
+
+/* Take up to 'max' (at most a slice) of a lane's events and dispatch
+ * them. Returns how many were taken. */
+static int dispatch_slice(AsyncEventQueue *queue, AsyncLane *lane, void *ctx, int max) {
+    AsyncEvent slice[ASYNC_DISPATCH_SLICE];
+    int n = 0;
+    while (n < max && lane_next(queue, lane, &slice[n], 1) == 0) {
+        n++;
+    }
+    collapse_slice(queue, slice, n);
+
+    for (int i = 0; i < n; i++) {
+        AsyncEvent *event = &slice[i];
+        if (event->type > ASYNC_EVENT_NONE && event->type < ASYNC_MAX_HANDLERS) {
+            AsyncTypeTiming *timing = &queue->timing[event->type];
+            uint64_t start = uv_hrtime();
+            hist_record(&timing->latency, start > (uint64_t)event->timestamp
+                                          ? start - (uint64_t)event->timestamp : 0);
+            AsyncEventHandler handler = queue->handlers[event->type];
             if (handler) {
-                handler(&event, ctx);
+                handler(event, ctx);
+                hist_record(&timing->handler, uv_hrtime() - start);
             }
         }
-        async_event_cleanup(&event);
-        count++;
+        async_event_cleanup(event);
+    }
+    return n;
+}
+
+int async_queue_dispatch_lanes(AsyncEventQueue *queue, void *ctx, uint64_t budget_ns,
+                               AsyncLaneId lowest) {
+    queue = resolve_queue(queue);
+    if (!queue) {
+        return 0;
     }
 
-    return count;
+    uint64_t start = budget_ns ? uv_hrtime() : 0;
+    int taken = 0;
+    int depth = async_queue_count(queue);
+    if (depth > 0) hist_record(&queue->depth, (uint64_t)depth);
+
+    /* Highest lane first; a lane with events gets a slice even once the
+     * budget is spent, and more while it is not. Those below 'lowest' get
+     * their share only. */
+    for (int l = 0; l < ASYNC_LANE_COUNT; l++) {
+        if (l > (int)lowest) {
+            taken += dispatch_slice(queue, &queue->lanes[l], ctx, ASYNC_LANE_SHARE);
+            continue;
+        }
+        int n;
+        do {
+            n = dispatch_slice(queue, &queue->lanes[l], ctx, ASYNC_DISPATCH_SLICE);
+            taken += n;
+        } while (n == ASYNC_DISPATCH_SLICE &&
+                 (!budget_ns || uv_hrtime() - start < budget_ns));
+    }
+
+    return taken;
+}
+
+int async_queue_dispatch(AsyncEventQueue *queue, void *ctx, uint64_t budget_ns) {
+    return async_queue_dispatch_lanes(queue, ctx, budget_ns, ASYNC_LANE_LOW);
 }
 
 /* ============================================================================
@@ -320,6 +919,18 @@ void async_queue_set_handler(AsyncEventQueue *queue, AsyncEventType type, AsyncE
     queue->handlers[type] = handler;
 }
 
+void async_queue_set_handler_lane(AsyncEventQueue *queue, AsyncEventType type,
+                                  AsyncEventHandler handler, AsyncLaneId lane) {
+    queue = resolve_queue(queue);
+    if (!queue || type <= ASYNC_EVENT_NONE || type >= ASYNC_MAX_HANDLERS ||
+        lane < 0 || lane >= ASYNC_LANE_COUNT) {
+        return;
+    }
+
+    queue->handlers[type] = handler;
+    atomic_store(&queue->lane[type], (int)lane);
+}
+
 AsyncEventHandler async_queue_get_handler(AsyncEventQueue *queue, AsyncEventType type) {
     queue = resolve_queue(queue);
     if (!queue || type <= ASYNC_EVENT_NONE || type >= ASYNC_MAX_HANDLERS) {
@@ -333,13 +944,78 @@ AsyncEventHandler async_queue_get_handler(AsyncEventQueue *queue, AsyncEventType
  * Utility Functions
  * ============================================================================ */
 
+void *async_payload_alloc(size_t len) {
+    int c = 0;
+    while (c < PAYLOAD_CLASSES && len > ((size_t)1 << (PAYLOAD_MIN_SHIFT + 2 * c))) c++;
+
+    PayloadHeader *block = NULL;
+    if (c < PAYLOAD_CLASSES) {
+        uv_once(&g_payloads_once, payloads_init);
+        uv_mutex_lock(&g_payloads[c].lock);
+        block = g_payloads[c].free;
+        if (block) {
+            g_payloads[c].free = block->h.next;
+            g_payloads[c].nfree--;
+        }
+        uv_mutex_unlock(&g_payloads[c].lock);
+    }
+
+    if (block) {
+        atomic_fetch_add_explicit(&g_payloads_reused, 1, memory_order_relaxed);
+    } else {
+        size_t size = c < PAYLOAD_CLASSES ? (size_t)1 << (PAYLOAD_MIN_SHIFT + 2 * c) : len;
+        block = malloc(sizeof(PayloadHeader) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->h.size_class = c < PAYLOAD_CLASSES ? c : -1;
+        atomic_fetch_add_explicit(&g_payloads_allocated, 1, memory_order_relaxed);
+    }
+    atomic_init(&block->h.refs, 1);
+    block->h.next = NULL;
+    return block + 1;
+}
+
+void async_payload_retain(void *payload) {
+    PayloadHeader *block = (PayloadHeader *)payload - 1;
+    atomic_fetch_add_explicit(&block->h.refs, 1, memory_order_relaxed);
+}
+
+void async_payload_release(void *payload) {
+    if (!payload) {
+        return;
+    }
+
+    PayloadHeader *block = (PayloadHeader *)payload - 1;
+    if (atomic_fetch_sub_explicit(&block->h.refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    int c = block->h.size_class;
+    if (c >= 0) {
+        uv_mutex_lock(&g_payloads[c].lock);
+        if (g_payloads[c].nfree < PAYLOAD_KEEP) {
+            block->h.next = g_payloads[c].free;
+            g_payloads[c].free = block;
+            g_payloads[c].nfree++;
+            block = NULL;
+        }
+        uv_mutex_unlock(&g_payloads[c].lock);
+    }
+    free(block);
+}
+
 void async_event_cleanup(AsyncEvent *event) {
     if (!event) {
         return;
     }
 
     if (event->heap_data) {
-        free(event->heap_data);
+        if (event->flags & ASYNC_FLAG_PAYLOAD) {
+            async_payload_release(event->heap_data);
+        } else {
+            free(event->heap_data);
+        }
         event->heap_data = NULL;
     }
 
@@ -350,7 +1026,16 @@ void async_event_cleanup(AsyncEvent *event) {
     }
 }
 
+void async_event_set_type_name(AsyncEventType type, const char *name) {
+    if (valid_type(type)) {
+        g_type_names[type] = name;
+    }
+}
+
 const char *async_event_type_name(AsyncEventType type) {
+    if (valid_type(type) && g_type_names[type]) {
+        return g_type_names[type];
+    }
     switch (type) {
         case ASYNC_EVENT_NONE:   return "NONE";
         case ASYNC_EVENT_TIMER:  return "TIMER";
@@ -5,7 +5,21 @@
  * notification.
  *
  * Features:
- * - Lock-free peek, mutex-protected push
+ * - Lock-free push from any number of threads, lock-free consumer
+ * - Capacity set at init, and what a push into a full queue does chosen
+ *   per event type: fail, wait for room, drop, or keep the newest only
+ * - Counters of events queued, refused, dropped and coalesced, and the
+ *   most queued at once
+ * - Batches pushed with one claim and one wakeup, and dispatch in slices
+ *   under a time budget, where events with a coalescing key collapse to
+ *   the latest of their type and key before reaching handlers
+ * - Priority lanes: high lanes are served first, and each lane with events
+ *   gets at least a slice per dispatch, so background work cannot hold up
+ *   the editor's own events nor starve
+ * - Pooled, refcounted payloads a producer fills and hands over without
+ *   a copy
+ * - Push-to-dispatch latency and handler time histograms per event
+ *   type, and of the queue's depth
  * - uv_async_t for waking the main thread
  * - Extensible event types with custom data
  * - Handler registration for automatic dispatch
@@ -42,10 +56,15 @@ typedef enum {
 #define ASYNC_CUSTOM_TAG_SIZE 32
 #define ASYNC_CALLBACK_NAME_SIZE 64
 
+/* Event flags */
+#define ASYNC_FLAG_PAYLOAD 0x1u     /* heap_data is from async_payload_alloc() */
+
 typedef struct AsyncEvent {
     AsyncEventType type;
     uint32_t flags;
     int64_t timestamp;              /* uv_hrtime() at push */
+    uint64_t coalesce_key;          /* Nonzero: superseded by a later event
+                                       of its type with the same key */
 
     union {
         /* ASYNC_EVENT_TIMER */
@@ -69,17 +88,62 @@ typedef struct AsyncEvent {
         } user;
     } data;
 
-    void *heap_data;                /* Non-NULL if data on heap, freed on pop */
+    void *heap_data;                /* Non-NULL if data on heap, freed (or with
+                                       ASYNC_FLAG_PAYLOAD, released) on pop */
 } AsyncEvent;
 
 /* ============================================================================
  * Queue Configuration
  * ============================================================================ */
 
-#define ASYNC_QUEUE_SIZE 256        /* Must be power of 2 */
+#define ASYNC_QUEUE_SIZE 256        /* Default capacity; all slots usable */
 #define ASYNC_QUEUE_SIZE_MASK (ASYNC_QUEUE_SIZE - 1)
+#define ASYNC_QUEUE_MAX_SIZE (1u << 20)
+#define ASYNC_DISPATCH_SLICE 64     /* Events taken off per slice */
+#define ASYNC_LANE_SHARE 8          /* Per dispatch, for lanes held back */
+
+/* What async_queue_push() does with an event of a type when the queue is
+ * full (see async_queue_set_policy()) */
+typedef enum {
+    ASYNC_POLICY_FAIL = 0,          /* Return -1; the caller retries or not */
+    ASYNC_POLICY_BLOCK,             /* Wait for room (producer threads) */
+    ASYNC_POLICY_DROP,              /* Discard it and return 1 */
+    ASYNC_POLICY_COALESCE           /* Hold it aside, replacing the event of
+                                       its type held there already */
+} AsyncPushPolicy;
+
+/* Priority lanes, highest first. Each has a ring of the queue's capacity;
+ * events go to the lane their type's handler was set for. */
+typedef enum {
+    ASYNC_LANE_HIGH = 0,            /* Feeds what the user is waiting on */
+    ASYNC_LANE_NORMAL,              /* Default */
+    ASYNC_LANE_LOW,                 /* Background work: search, prefetch */
+    ASYNC_LANE_COUNT
+} AsyncLaneId;
+
+/* Counters since async_queue_init() */
+typedef struct AsyncQueueStats {
+    uint32_t capacity;              /* Events each lane's ring holds */
+    uint32_t high_water;            /* Most events queued at once in a lane */
+    uint64_t pushed;                /* Events queued */
+    uint64_t rejected;              /* Pushes refused as full (-1) */
+    uint64_t dropped;               /* ASYNC_POLICY_DROP events discarded */
+    uint64_t coalesced;             /* Events replaced by newer ones */
+    uint64_t blocked;               /* ASYNC_POLICY_BLOCK pushes that waited */
+    uint64_t payloads_reused;       /* Payloads taken from the pool */
+    uint64_t payloads_allocated;    /* Payloads the pool had to allocate */
+} AsyncQueueStats;
 #define ASYNC_MAX_HANDLERS 32
 
+/* Summary of a histogram: of nanoseconds, or for depth of events. The
+ * percentiles are within 12.5%. */
+typedef struct AsyncHistStats {
+    uint64_t count;                 /* Values recorded */
+    uint64_t mean;
+    uint64_t p50, p90, p99;
+    uint64_t max;
+} AsyncHistStats;
+
 /* ============================================================================
  * Event Handler Type
  * ============================================================================ */
@@ -104,6 +168,16 @@ typedef struct AsyncEventQueue AsyncEventQueue;
  */
 int async_queue_init(void);
 
+/**
+ * Initialize the global async event queue with room for 'capacity'
+ * events, rounded up to a power of 2 (at most ASYNC_QUEUE_MAX_SIZE).
+ * async_queue_init() is this with ASYNC_QUEUE_SIZE.
+ *
+ * @return 0 on success, -1 on error (or if already initialized with
+ *         a different capacity)
+ */
+int async_queue_init_sized(uint32_t capacity);
+
 /**
  * Clean up the global async event queue.
  */
@@ -125,10 +199,91 @@ AsyncEventQueue *async_queue_global(void);
  *
  * @param queue The event queue (or NULL for global)
  * @param event The event to push (copied into queue)
- * @return 0 on success, -1 if queue is full
+ * @return 0 on success (or held aside to coalesce), -1 if queue is full
+ *         under ASYNC_POLICY_FAIL (or BLOCK on the consumer's thread),
+ *         1 if dropped under ASYNC_POLICY_DROP
  */
 int async_queue_push(AsyncEventQueue *queue, const AsyncEvent *event);
 
+/**
+ * Push a custom tagged event whose data is a payload from
+ * async_payload_alloc(), handing it over without a copy: once queued,
+ * the queue releases it after dispatch.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param tag Event tag (max 31 chars)
+ * @param payload Payload (or NULL)
+ * @param len Bytes of it used
+ * @return As async_queue_push(); unless 0, the payload stays the caller's
+ */
+int async_queue_push_payload(AsyncEventQueue *queue, const char *tag, void *payload, size_t len);
+
+/**
+ * Push several events, in order. As many as there is room for are
+ * queued with one claim on the ring and one wakeup; the rest go through
+ * async_queue_push() one at a time, as their types' policies say.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param events The events to push (copied into queue)
+ * @param n Number of events
+ * @return Number of events taken (queued, held or dropped), stopping at
+ *         the first one refused, whose heap data stays the caller's as
+ *         do the ones after it; -1 on bad arguments
+ */
+int async_queue_push_batch(AsyncEventQueue *queue, const AsyncEvent *events, int n);
+
+/**
+ * Set what pushing an event of a type into a full queue does.
+ * Default ASYNC_POLICY_FAIL. Events held aside by ASYNC_POLICY_COALESCE
+ * come out after those queued before them, so only a type whose newest
+ * event supersedes the older ones (progress, state) should use it.
+ * ASYNC_POLICY_BLOCK waits on the consumer, so bounds memory without
+ * losing events, and fails rather than waits on the consumer's thread.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param type Event type
+ * @param policy Policy for it
+ */
+void async_queue_set_policy(AsyncEventQueue *queue, AsyncEventType type, AsyncPushPolicy policy);
+
+/**
+ * Get the counters of a queue.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param stats Output: the counters (zeroed if no queue)
+ */
+void async_queue_get_stats(AsyncEventQueue *queue, AsyncQueueStats *stats);
+
+/**
+ * Get the dispatch timings of an event type since init (or the last
+ * async_queue_reset_timing()): time from push to dispatch, and of its
+ * handler. Main thread only.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param type Event type
+ * @param latency Output: push to dispatch (or NULL)
+ * @param handler Output: handler run time (or NULL)
+ * @return 0, or -1 if no event of the type was dispatched
+ */
+int async_queue_get_type_stats(AsyncEventQueue *queue, AsyncEventType type,
+                               AsyncHistStats *latency, AsyncHistStats *handler);
+
+/**
+ * Get the events queued when each dispatch began, of those that found
+ * any. Main thread only.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param depth Output: the summary (zeroed if no queue)
+ */
+void async_queue_get_depth_stats(AsyncEventQueue *queue, AsyncHistStats *depth);
+
+/**
+ * Clear the dispatch timings and depth histogram. Main thread only.
+ *
+ * @param queue The event queue (or NULL for global)
+ */
+void async_queue_reset_timing(AsyncEventQueue *queue);
+
 /**
  * Push a timer event.
  *
@@ -155,7 +310,8 @@ int async_queue_push_custom(AsyncEventQueue *queue, const char *tag, const void
  * ============================================================================ */
 
 /**
- * Peek at the next event without removing it.
+ * Peek at the next event without removing it. The next event is the
+ * oldest of the highest lane with events.
  *
  * @param queue The event queue (or NULL for global)
  * @param event Output: the next event
@@ -187,6 +343,15 @@ void async_queue_pop(AsyncEventQueue *queue);
  */
 int async_queue_is_empty(AsyncEventQueue *queue);
 
+/**
+ * Check if a lane is empty.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param lane Lane
+ * @return 1 if empty (or no queue), 0 if events pending
+ */
+int async_queue_lane_is_empty(AsyncEventQueue *queue, AsyncLaneId lane);
+
 /**
  * Get the number of pending events.
  *
@@ -204,12 +369,44 @@ int async_queue_count(AsyncEventQueue *queue);
  */
 int async_queue_dispatch_all(AsyncEventQueue *queue, void *ctx);
 
+/**
+ * Dispatch pending events to registered handlers in slices of up to
+ * ASYNC_DISPATCH_SLICE, highest lane first. Each lane with events gets one
+ * slice, and more while the time budget lasts, so a busy high lane delays
+ * low ones by a budget at most and no lane starves. Within a slice, an event with a coalescing key is dropped
+ * (counted as coalesced) when a later one of its type has the same key.
+ * Events left over wait for the next call; async_queue_is_empty() says
+ * whether there are any.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param ctx Context passed to handlers
+ * @param budget_ns Time budget in nanoseconds, 0 for none
+ * @return Number of events taken off the queue
+ */
+int async_queue_dispatch(AsyncEventQueue *queue, void *ctx, uint64_t budget_ns);
+
+/**
+ * Dispatch as async_queue_dispatch(), from the high lane down to 'lowest';
+ * the lanes below it get ASYNC_LANE_SHARE events each, so that they are
+ * slowed but not starved. The editor dispatches down to ASYNC_LANE_HIGH
+ * while keystrokes are waiting.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param ctx Context passed to handlers
+ * @param budget_ns Time budget in nanoseconds, 0 for none
+ * @param lowest Lowest lane to dispatch
+ * @return Number of events taken off the queue
+ */
+int async_queue_dispatch_lanes(AsyncEventQueue *queue, void *ctx, uint64_t budget_ns,
+                               AsyncLaneId lowest);
+
 /* ============================================================================
  * Handler Registration
  * ============================================================================ */
 
 /**
- * Set a handler for a specific event type.
+ * Set a handler for a specific event type, leaving the type's lane as it
+ * is (ASYNC_LANE_NORMAL unless set).
  *
  * @param queue The event queue (or NULL for global)
  * @param type Event type to handle
@@ -217,6 +414,19 @@ int async_queue_dispatch_all(AsyncEventQueue *queue, void *ctx);
  */
 void async_queue_set_handler(AsyncEventQueue *queue, AsyncEventType type, AsyncEventHandler handler);
 
+/**
+ * Set a handler for an event type, and the lane its events go to. Set it
+ * before events of the type are pushed: ones queued already stay in the
+ * lane they went to.
+ *
+ * @param queue The event queue (or NULL for global)
+ * @param type Event type to handle
+ * @param handler Handler function (NULL to unregister)
+ * @param lane Lane for events of the type
+ */
+void async_queue_set_handler_lane(AsyncEventQueue *queue, AsyncEventType type,
+                                  AsyncEventHandler handler, AsyncLaneId lane);
+
 /**
  * Get the current handler for an event type.
  *
@@ -230,6 +440,32 @@ AsyncEventHandler async_queue_get_handler(AsyncEventQueue *queue, AsyncEventType
  * Utility Functions
  * ============================================================================ */
 
+/**
+ * Allocate an event payload of at least 'len' bytes, from a pool of
+ * blocks in size classes (64 bytes to 16K; larger ones come from malloc
+ * and go back to it). Any thread. It starts with one reference.
+ *
+ * @param len Bytes needed
+ * @return The payload, or NULL if out of memory
+ */
+void *async_payload_alloc(size_t len);
+
+/**
+ * Take another reference to a payload, e.g. for a handler that keeps an
+ * event's data past dispatch. Any thread.
+ *
+ * @param payload Payload from async_payload_alloc()
+ */
+void async_payload_retain(void *payload);
+
+/**
+ * Drop a reference to a payload; the last one gives it back to the pool.
+ * Any thread.
+ *
+ * @param payload Payload from async_payload_alloc() (or NULL)
+ */
+void async_payload_release(void *payload);
+
 /**
  * Free any heap-allocated data in an event.
  *
@@ -237,6 +473,14 @@ AsyncEventHandler async_queue_get_handler(AsyncEventQueue *queue, AsyncEventType
  */
 void async_event_cleanup(AsyncEvent *event);
 
+/**
+ * Name an event type, for async_event_type_name() and the stats.
+ *
+ * @param type Event type
+ * @param name Name (not copied: a string literal)
+ */
+void async_event_set_type_name(AsyncEventType type, const char *name);
+
 /**
  * Get the name of an event type (for debugging).
  *
@@ -0,0 +1,337 @@
+/* autocmd.c - Autocommands: functions run on editor events
+ *
+ * See autocmd.h for an overview. A handler is on the list of each of its
+ * events at once (next[] has a link per event). One removed while
+ * handlers run is marked dead, skipped, and freed once the outermost
+ * autocmd_fire() returns.
+ */
+
+#define _DEFAULT_SOURCE     /* strdup() */
+
+#include "autocmd.h"
+#include "lang_bridge.h"
+#include "timer_wheel.h"
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef enum GlobKind {
+    GLOB_ANY,                   /* "*" */
+    GLOB_EXACT,                 /* No wildcard */
+    GLOB_SUFFIX,                /* "*" then a literal */
+    GLOB_PREFIX,                /* A literal then "*" */
+    GLOB_FNMATCH                /* Anything else */
+} GlobKind;
+
+typedef struct AutocmdGlob {
+    GlobKind kind;
+    int path;                   /* Has a '/': matches the whole name */
+    char *text;                 /* The literal, or the glob for fnmatch() */
+    size_t len;
+} AutocmdGlob;
+
+typedef struct Autocmd {
+    int id;
+    unsigned events;
+    int dead;                   /* Removed while handlers ran */
+    AutocmdGlob *globs;
+    int nglobs;
+    AutocmdFn fn;
+    void (*release)(void *opaque);
+    void *opaque;
+    struct Autocmd *next[AUTOCMD_EVENTS];
+} Autocmd;
+
+static const char *const event_names[AUTOCMD_EVENTS] = {
+    "BufRead", "BufWrite", "InsertLeave", "CursorHold", "FileType"
+};
+
+static Autocmd *handlers[AUTOCMD_EVENTS];
+static int next_id = 1;
+static int firing = 0;          /* autocmd_fire() calls under way */
+static int dead = 0;            /* Handlers waiting for them to end */
+static int hold_ms = AUTOCMD_HOLD_MS;
+static int hold_timer = 0;      /* CursorHold's timer, or 0 */
+static char hold_tag;           /* Its userdata */
+
+int autocmd_event_by_name(const char *name) {
+    for (int i = 0; i < AUTOCMD_EVENTS; i++)
+        if (strcasecmp(name, event_names[i]) == 0) return i;
+    return -1;
+}
+
+const char *autocmd_event_name(AutocmdEvent event) {
+    return event >= 0 && event < AUTOCMD_EVENTS ? event_names[event] : "";
+}
+
+/* ========================= Patterns ========================= */
+
+static int has_wildcard(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') return 1;
+    return 0;
+}
+
+static void glob_compile(AutocmdGlob *g, const char *s, size_t len) {
+    g->path = memchr(s, '/', len) != NULL;
+    g->kind = GLOB_FNMATCH;
+    if (len == 1 && s[0] == '*') {
+        g->kind = GLOB_ANY;
+    } else if (!has_wildcard(s, len)) {
+        g->kind = GLOB_EXACT;
+    } else if (s[0] == '*' && !has_wildcard(s + 1, len - 1)) {
+        g->kind = GLOB_SUFFIX;
+        s++, len--;
+    } else if (s[len - 1] == '*' && !has_wildcard(s, len - 1)) {
+        g->kind = GLOB_PREFIX;
+        len--;
+    }
+    g->text = malloc(len + 1);
+    if (g->text == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(g->text, s, len);
+    g->text[len] = '\0';
+    g->len = len;
+}
+
+/* The globs of a comma separated pattern; none for NULL or "" */
+static int pattern_compile(const char *pattern, AutocmdGlob **out) {
+    *out = NULL;
+    if (pattern == NULL || pattern[0] == '\0') return 0;
+    int n = 1;
+    for (const char *p = pattern; *p; p++) n += *p == ',';
+    AutocmdGlob *globs = calloc((size_t)n, sizeof(AutocmdGlob));
+    if (globs == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int count = 0;
+    const char *s = pattern;
+    for (;;) {
+        const char *end = strchr(s, ',');
+        size_t len = end ? (size_t)(end - s) : strlen(s);
+        if (len > 0) glob_compile(&globs[count++], s, len);
+        if (end == NULL) break;
+        s = end + 1;
+    }
+    *out = globs;
+    return count;
+}
+
+static void pattern_free(AutocmdGlob *globs, int count) {
+    for (int i = 0; i < count; i++) free(globs[i].text);
+    free(globs);
+}
+
+static int glob_match(const AutocmdGlob *g, const char *name, size_t len,
+                      const char *base, size_t base_len) {
+    if (g->kind == GLOB_ANY) return 1;
+    if (!g->path) {
+        name = base;
+        len = base_len;
+    }
+    switch (g->kind) {
+    case GLOB_EXACT:
+        return len == g->len && memcmp(name, g->text, len) == 0;
+    case GLOB_SUFFIX:
+        return len >= g->len && memcmp(name + len - g->len, g->text, g->len) == 0;
+    case GLOB_PREFIX:
+        return len >= g->len && memcmp(name, g->text, g->len) == 0;
+    default:
+        return fnmatch(g->text, name, g->path ? FNM_PATHNAME : 0) == 0;
+    }
+}
+
+/* Whether 'match' matches one of the globs ("*" for none). Only "*"
+ * matches "", an unnamed buffer. */
+static int globs_match(const AutocmdGlob *globs, int count, const char *match) {
+    if (count == 0) return 1;
+    size_t len = strlen(match);
+    const char *base = strrchr(match, '/');
+    base = base ? base + 1 : match;
+    size_t base_len = len - (size_t)(base - match);
+    for (int i = 0; i < count; i++) {
+        if (globs[i].kind == GLOB_ANY) return 1;
+        if (len > 0 && glob_match(&globs[i], match, len, base, base_len)) return 1;
+    }
+    return 0;
+}
+
+int autocmd_match(const char *pattern, const char *match) {
+    AutocmdGlob *globs;
+    int count = pattern_compile(pattern, &globs);
+    int matched = globs_match(globs, count, match);
+    pattern_free(globs, count);
+    return matched;
+}
+
+/* ========================= Handlers ========================= */
+
+int autocmd_add(unsigned events, const char *pattern, AutocmdFn fn,
+                void (*release)(void *opaque), void *opaque) {
+    events &= (1u << AUTOCMD_EVENTS) - 1;
+    if (events == 0) return -1;
+    Autocmd *a = calloc(1, sizeof(Autocmd));
+    if (a == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    a->id = next_id++;
+    a->events = events;
+    a->nglobs = pattern_compile(pattern, &a->globs);
+    a->fn = fn;
+    a->release = release;
+    a->opaque = opaque;
+
+    /* Last on each list: handlers run in the order they were added */
+    for (int ev = 0; ev < AUTOCMD_EVENTS; ev++) {
+        if (!(events & (1u << ev))) continue;
+        Autocmd **p = &handlers[ev];
+        while (*p) p = &(*p)->next[ev];
+        *p = a;
+    }
+    if (events & (1u << AUTOCMD_CURSOR_HOLD)) autocmd_note_input();
+    return a->id;
+}
+
+static void handler_free(Autocmd *a) {
+    if (a->release) a->release(a->opaque);
+    pattern_free(a->globs, a->nglobs);
+    free(a);
+}
+
+/* Take the dead handlers off their lists and free them */
+static void sweep(void) {
+    Autocmd *gone = NULL;
+    for (int ev = 0; ev < AUTOCMD_EVENTS; ev++) {
+        Autocmd **p = &handlers[ev];
+        while (*p) {
+            Autocmd *a = *p;
+            if (!a->dead) {
+                p = &a->next[ev];
+                continue;
+            }
+            *p = a->next[ev];
+            a->events &= ~(1u << ev);
+            /* Freed once off its last list, linked through it */
+            if (a->events == 0) {
+                a->next[0] = gone;
+                gone = a;
+            }
+        }
+    }
+    dead = 0;
+    while (gone) {
+        Autocmd *next = gone->next[0];
+        handler_free(gone);
+        gone = next;
+    }
+}
+
+int autocmd_del(int id) {
+    for (int ev = 0; ev < AUTOCMD_EVENTS; ev++) {
+        for (Autocmd *a = handlers[ev]; a; a = a->next[ev]) {
+            if (a->id != id || a->dead) continue;
+            a->dead = 1;
+            dead++;
+            if (firing == 0) sweep();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void autocmd_clear(void) {
+    for (int ev = 0; ev < AUTOCMD_EVENTS; ev++) {
+        for (Autocmd *a = handlers[ev]; a; a = a->next[ev]) {
+            if (!a->dead) dead++;
+            a->dead = 1;
+        }
+    }
+    if (firing == 0) sweep();
+    if (hold_timer > 0) timer_service_cancel(hold_timer);
+    hold_timer = 0;
+}
+
+int autocmd_has(AutocmdEvent event) {
+    return handlers[event] != NULL;
+}
+
+const char *autocmd_filetype(editor_ctx_t *ctx, char *buf, size_t size) {
+    const char *filename = ctx->model.filename;
+    if (filename == NULL) return "";
+    const char *lang = loki_lang_resolve(ctx)->ts_lang;
+    if (lang) return lang;
+
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    const char *dot = strrchr(base, '.');
+    if (dot == NULL || dot == base || dot[1] == '\0') return "";
+    snprintf(buf, size, "%s", dot + 1);
+    for (char *p = buf; *p; p++)
+        if (*p >= 'A' && *p <= 'Z') *p = (char)(*p - 'A' + 'a');
+    return buf;
+}
+
+void autocmd_fire(editor_ctx_t *ctx, AutocmdEvent event) {
+    if (handlers[event] == NULL) return;
+
+    char type[64];
+    const char *match;
+    if (event == AUTOCMD_FILE_TYPE) {
+        match = autocmd_filetype(ctx, type, sizeof(type));
+        if (match[0] == '\0') return;
+    } else {
+        match = ctx->model.filename ? ctx->model.filename : "";
+    }
+    /* A handler may rename the buffer: the name it was fired for stays */
+    char *copy = strdup(match);
+    if (copy == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    /* Handlers added now are on the lists, run by this call if they are
+     * for this event */
+    firing++;
+    for (Autocmd *a = handlers[event]; a; a = a->next[event]) {
+        if (a->dead || !globs_match(a->globs, a->nglobs, copy)) continue;
+        a->fn(ctx, event, copy, a->opaque);
+    }
+    if (--firing == 0 && dead > 0) sweep();
+    free(copy);
+}
+
+void autocmd_file_read(editor_ctx_t *ctx) {
+    autocmd_fire(ctx, AUTOCMD_BUF_READ);
+    autocmd_fire(ctx, AUTOCMD_FILE_TYPE);
+}
+
+/* ========================= CursorHold ========================= */
+
+void autocmd_note_input(void) {
+    if (hold_timer > 0) timer_service_cancel(hold_timer);
+    hold_timer = 0;
+    if (handlers[AUTOCMD_CURSOR_HOLD] == NULL) return;
+    int id = timer_service_add((uint64_t)hold_ms, 0, &hold_tag);
+    if (id > 0) hold_timer = id;
+}
+
+int autocmd_timer_fired(void *userdata, editor_ctx_t *ctx) {
+    if (userdata != &hold_tag) return 0;
+    hold_timer = 0;
+    if (ctx && ctx->view.mode == MODE_NORMAL) autocmd_fire(ctx, AUTOCMD_CURSOR_HOLD);
+    return 1;
+}
+
+void autocmd_set_hold_ms(int ms) {
+    hold_ms = ms > 0 ? ms : 1;
+}
+
+int autocmd_get_hold_ms(void) {
+    return hold_ms;
+}
@@ -0,0 +1,89 @@
+/* autocmd.h - Autocommands: functions run on editor events
+ *
+ * A handler is registered for one or more events and a pattern, vim's
+ * way: the file name of the buffer (its last component, unless the
+ * pattern has a '/') or, for FileType, the file type must match it.
+ * Patterns are globs, several separated by commas ("*.c,*.h"), compiled
+ * when the handler is added: an exact name, a literal suffix ("*.c") or
+ * prefix ("test_*"), or anything ("*") is matched with one comparison,
+ * and only other globs go to fnmatch().
+ *
+ * Each event has a list of its handlers, so an event with none costs
+ * one load and a test where it happens: nothing is matched, allocated or
+ * called, and Lua is not entered. Handlers added or removed while an
+ * event runs them are safe.
+ *
+ * CursorHold runs once the keys have stopped for updatetime ms in NORMAL
+ * mode (:set updatetime=N, 4000 by default), through a timer of the
+ * timer wheel re-armed at each key, and only while a handler waits for
+ * it. The file type is the buffer's tree-sitter language, or else the
+ * extension of its file name. Lua has it as loki.autocmd().
+ */
+
+#ifndef LOKI_AUTOCMD_H
+#define LOKI_AUTOCMD_H
+
+#include "internal.h"
+
+typedef enum AutocmdEvent {
+    AUTOCMD_BUF_READ = 0,       /* A file was read into a buffer */
+    AUTOCMD_BUF_WRITE,          /* A buffer was written to its file */
+    AUTOCMD_INSERT_LEAVE,       /* INSERT mode was left */
+    AUTOCMD_CURSOR_HOLD,        /* No key for updatetime ms, in NORMAL mode */
+    AUTOCMD_FILE_TYPE,          /* A buffer's file type was set, on read */
+    AUTOCMD_EVENTS
+} AutocmdEvent;
+
+/* CursorHold delay by default, ms */
+#define AUTOCMD_HOLD_MS 4000
+
+/* Called with the buffer, the event, and what the pattern matched */
+typedef void (*AutocmdFn)(editor_ctx_t *ctx, AutocmdEvent event,
+                          const char *match, void *opaque);
+
+/* The event named 'name' (BufRead, bufread, ...), or -1 */
+int autocmd_event_by_name(const char *name);
+
+/* Its name, as vim spells it */
+const char *autocmd_event_name(AutocmdEvent event);
+
+/* Run 'fn' on the events of 'events' (a bit per AutocmdEvent) for
+ * buffers matching 'pattern' (NULL: "*"). 'release', if not NULL, is
+ * called with 'opaque' when the handler goes. Returns its id, > 0, or
+ * -1 if 'events' names none. */
+int autocmd_add(unsigned events, const char *pattern, AutocmdFn fn,
+                void (*release)(void *opaque), void *opaque);
+
+/* Remove a handler. Returns 0, or -1 if there is none. */
+int autocmd_del(int id);
+
+/* Remove them all */
+void autocmd_clear(void);
+
+/* Whether some handler is registered for 'event' */
+int autocmd_has(AutocmdEvent event);
+
+/* Run the handlers of 'event' matching the buffer of 'ctx' */
+void autocmd_fire(editor_ctx_t *ctx, AutocmdEvent event);
+
+/* A file was read into the buffer: BufRead, then FileType */
+void autocmd_file_read(editor_ctx_t *ctx);
+
+/* Whether 'match' matches 'pattern' as a handler's pattern would */
+int autocmd_match(const char *pattern, const char *match);
+
+/* The file type of the buffer, as FileType matches it ("" if none) */
+const char *autocmd_filetype(editor_ctx_t *ctx, char *buf, size_t size);
+
+/* A key was handled: CursorHold waits for the next quiet */
+void autocmd_note_input(void);
+
+/* The timer of ASYNC_EVENT_TIMER 'userdata' fired: if it is CursorHold's,
+ * run it on 'ctx', the current buffer, and return 1; else 0. */
+int autocmd_timer_fired(void *userdata, editor_ctx_t *ctx);
+
+/* CursorHold's delay, ms */
+void autocmd_set_hold_ms(int ms);
+int autocmd_get_hold_ms(void);
+
+#endif /* LOKI_AUTOCMD_H */
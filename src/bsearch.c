@@ -0,0 +1,304 @@
+/* bsearch.c - Searching every open buffer
+ *
+ * See bsearch.h for an overview. A BufferSearch holds one search: the
+ * buffers to look at, with the rows the index lists for each, and one
+ * match array per buffer that only the worker searching it writes to.
+ * Workers take the next buffer under a mutex; the arrays are joined in
+ * buffer order once every worker is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "bsearch.h"
+#include "buffers.h"
+#include "regexp.h"
+#include "search.h"
+#include "task_pool.h"
+
+typedef struct BufferSearch {
+    int nbufs;
+    int *ids;
+    editor_ctx_t **ctxs;
+    SearchRanges *rows;
+    BufferMatches *found;
+    int max;
+
+    const char *pattern;
+    int regex, re_flags;
+    SearchPattern pat;        /* Plain text queries */
+
+    uv_mutex_t lock;          /* Guards next_buf */
+    int next_buf;
+} BufferSearch;
+
+/* The list :bsearch keeps */
+static BufferMatches bsearch_matches;
+static int bsearch_current = -1;
+
+void bsearch_matches_free(BufferMatches *bm) {
+    free(bm->m);
+    bm->m = NULL;
+    bm->n = bm->cap = 0;
+}
+
+static void matches_add(BufferMatches *bm, int id, int row, int off, int len) {
+    if (bm->n == bm->cap) {
+        int cap = bm->cap ? bm->cap * 2 : 64;
+        BufferMatch *m = realloc(bm->m, sizeof(BufferMatch) * (size_t)cap);
+        if (m == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        bm->m = m;
+        bm->cap = cap;
+    }
+    BufferMatch *m = &bm->m[bm->n++];
+    m->buffer_id = id;
+    m->row = row;
+    m->off = off;
+    m->len = len;
+}
+
+/* Matches in one row, until 'out' has bs->max. Empty regex matches skip a
+ * character, as when counting. */
+static void search_row(BufferSearch *bs, Regexp *re, int id, int r,
+                       const t_erow *row, BufferMatches *out) {
+    int i = 0;
+    if (re) {
+        int start, end;
+        while (out->n < bs->max && i <= row->size &&
+               regexp_search(re, row->chars, row->size, i, &start, &end)) {
+            matches_add(out, id, r, start, end - start);
+            i = end > start ? end : end + 1;
+        }
+        return;
+    }
+    const char *match;
+    while (out->n < bs->max && i < row->size &&
+           (match = search_pattern_find(&bs->pat, row->chars + i,
+                                        (size_t)(row->size - i))) != NULL) {
+        int off = (int)(match - row->chars);
+        matches_add(out, id, r, off, bs->pat.len);
+        i = off + bs->pat.len;
+    }
+}
+
+static void search_buffer(BufferSearch *bs, Regexp *re, int b) {
+    const EditorModel *model = &bs->ctxs[b]->model;
+    const SearchRanges *rows = &bs->rows[b];
+    BufferMatches *out = &bs->found[b];
+    for (int i = 0; i < rows->n && out->n < bs->max; i++) {
+        int last = rows->r[i].last < model->numrows - 1 ? rows->r[i].last
+                                                        : model->numrows - 1;
+        for (int r = rows->r[i].first; r <= last && out->n < bs->max; r++)
+            search_row(bs, re, bs->ids[b], r, &model->row[r], out);
+    }
+}
+
+static void bsearch_worker(void *arg) {
+    BufferSearch *bs = arg;
+    const char *error;
+    /* The DFA fills in as it runs, so each thread has its own */
+    Regexp *re = bs->regex ? regexp_compile(bs->pattern, bs->re_flags, &error)
+                           : NULL;
+
+    for (;;) {
+        uv_mutex_lock(&bs->lock);
+        int b = bs->next_buf++;
+        uv_mutex_unlock(&bs->lock);
+        if (b >= bs->nbufs) break;
+        search_buffer(bs, re, b);
+    }
+    regexp_free(re);
+}
+
+static int worker_count(int tasks) {
+    int n = task_pool_threads();
+    if (n > tasks) n = tasks;
+    if (n > BSEARCH_MAX_WORKERS) n = BSEARCH_MAX_WORKERS;
+    return n;
+}
+
+int bsearch_run(editor_ctx_t *ctx, const char *pattern, int flags, int max,
+                BufferMatches *out, const char **error) {
+    memset(out, 0, sizeof(*out));
+    BufferSearch *bs = calloc(1, sizeof(BufferSearch));
+    if (bs == NULL || uv_mutex_init(&bs->lock) != 0) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int len = (int)strlen(pattern);
+    bs->pattern = pattern;
+    bs->regex = !(flags & BSEARCH_LITERAL);
+    bs->max = max > 0 && max < BSEARCH_MAX_MATCHES ? max : BSEARCH_MAX_MATCHES;
+    int icase = (flags & BSEARCH_ICASE) ||
+                (!(flags & BSEARCH_CASE) && ctx &&
+                 search_ignores_case(ctx, pattern, len, bs->regex));
+
+    Regexp *re = NULL;
+    if (bs->regex) {
+        bs->re_flags = icase ? REGEXP_ICASE : 0;
+        re = regexp_compile(pattern, bs->re_flags, error);
+        if (!re) {
+            uv_mutex_destroy(&bs->lock);
+            free(bs);
+            return -1;
+        }
+    } else {
+        search_pattern_init_icase(&bs->pat, pattern, len, icase);
+    }
+
+    /* Without the buffer list (headless sessions) 'ctx' is the only one */
+    int nalloc = buffer_count() > 0 ? buffer_count() : 1;
+    bs->ids = malloc(sizeof(int) * (size_t)nalloc);
+    bs->ctxs = malloc(sizeof(editor_ctx_t *) * (size_t)nalloc);
+    bs->rows = calloc((size_t)nalloc, sizeof(SearchRanges));
+    bs->found = calloc((size_t)nalloc, sizeof(BufferMatches));
+    if (!bs->ids || !bs->ctxs || !bs->rows || !bs->found) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int n = buffer_get_list(bs->ids, nalloc);
+    for (int i = 0; i < n; i++) {
+        /* Buffers on one document are searched once, as the first */
+        editor_ctx_t *c = buffer_get(bs->ids[i]);
+        int seen = 0;
+        for (int b = 0; b < bs->nbufs && !seen; b++) seen = bs->ctxs[b] == c;
+        if (seen) continue;
+        bs->ids[bs->nbufs] = bs->ids[i];
+        bs->ctxs[bs->nbufs++] = c;
+    }
+    if (bs->nbufs == 0 && ctx) {
+        bs->ids[0] = -1;
+        bs->ctxs[0] = ctx;
+        bs->nbufs = 1;
+    }
+    /* Index lookups may start a build, so they stay on this thread */
+    for (int b = 0; b < bs->nbufs; b++) {
+        if (re) search_regexp_rows(bs->ctxs[b], re, &bs->rows[b]);
+        else search_pattern_rows(bs->ctxs[b], &bs->pat, &bs->rows[b]);
+    }
+    regexp_free(re);
+
+    Task *tasks[BSEARCH_MAX_WORKERS];
+    int ntasks = 0, nworkers = worker_count(bs->nbufs);
+    while (nworkers > 1 && ntasks < nworkers &&
+           (tasks[ntasks] = task_submit(bsearch_worker, bs, TASK_PRIORITY_HIGH, NULL)))
+        ntasks++;
+    if (ntasks == 0) bsearch_worker(bs);    /* One buffer, or no threads */
+    for (int i = 0; i < ntasks; i++) task_wait(tasks[i]);
+
+    /* Join the buffers' matches, in order, up to the limit */
+    for (int b = 0; b < bs->nbufs; b++) {
+        BufferMatches *f = &bs->found[b];
+        for (int i = 0; i < f->n && out->n < bs->max; i++)
+            matches_add(out, f->m[i].buffer_id, f->m[i].row, f->m[i].off,
+                        f->m[i].len);
+        bsearch_matches_free(f);
+        search_ranges_free(&bs->rows[b]);
+    }
+    out->buffers = bs->nbufs;
+    uv_mutex_destroy(&bs->lock);
+    free(bs->ids);
+    free(bs->ctxs);
+    free(bs->rows);
+    free(bs->found);
+    free(bs);
+    return out->n;
+}
+
+/* ======================== The :bsearch list ======================== */
+
+const BufferMatches *bsearch_list(int *current) {
+    if (current) *current = bsearch_current;
+    return &bsearch_matches;
+}
+
+void bsearch_clear(void) {
+    bsearch_matches_free(&bsearch_matches);
+    bsearch_matches.buffers = 0;
+    bsearch_current = -1;
+}
+
+/* The buffer a match is in: 'ctx' when it has no id, NULL once closed */
+static editor_ctx_t *match_buffer(editor_ctx_t *ctx, const BufferMatch *m) {
+    return m->buffer_id < 0 ? ctx : buffer_get(m->buffer_id);
+}
+
+/* Put the cursor on match 'i', switching to its buffer */
+static void show_match(editor_ctx_t *ctx, int i) {
+    const BufferMatch *m = &bsearch_matches.m[i];
+    editor_ctx_t *target = match_buffer(ctx, m);
+    if (m->buffer_id >= 0 && m->buffer_id != buffer_get_current_id())
+        buffer_switch(m->buffer_id);
+    bsearch_current = i;
+
+    int r = m->row < target->model.numrows ? m->row : target->model.numrows - 1;
+    if (r < 0) r = 0;
+    int start = 0, cols = 0;
+    if (r < target->model.numrows) {
+        t_erow *row = &target->model.row[r];
+        int off = m->off < row->size ? m->off : row->size;
+        int end = off + m->len < row->size ? off + m->len : row->size;
+        start = search_render_col(row, off);
+        cols = search_render_col(row, end) - start;
+        editor_visible_row(target, r, start, cols);
+    }
+    /* Placed as a match found with '/' is */
+    target->view.cy = 0;
+    target->view.cx = start;
+    target->view.rowoff = r;
+    target->view.coloff = 0;
+    if (target->view.cx > target->view.screencols) {
+        int diff = target->view.cx - target->view.screencols;
+        target->view.cx -= diff;
+        target->view.coloff += diff;
+    }
+
+    const char *name = m->buffer_id >= 0 ? buffer_get_display_name(m->buffer_id)
+                                         : NULL;
+    editor_set_status_msg(target, "%s:%d:%d (match %d of %d)",
+                          name ? name : "[No Name]", r + 1, m->off + 1, i + 1,
+                          bsearch_matches.n);
+}
+
+int bsearch_jump(editor_ctx_t *ctx, int step) {
+    int n = bsearch_matches.n;
+    if (n == 0) {
+        editor_set_status_msg(ctx, "bsearch: No matches (use :bsearch pattern)");
+        return -1;
+    }
+    /* Matches in closed buffers are passed over */
+    int i = bsearch_current;
+    for (int tries = 0; tries < n; tries++) {
+        if (i < 0) i = step > 0 ? 0 : n - 1;
+        else i = ((i + step) % n + n) % n;
+        if (match_buffer(ctx, &bsearch_matches.m[i])) {
+            show_match(ctx, i);
+            return 0;
+        }
+    }
+    editor_set_status_msg(ctx, "bsearch: The buffers of the matches are closed");
+    return -1;
+}
+
+int bsearch_start(editor_ctx_t *ctx, const char *pattern, int flags) {
+    bsearch_clear();
+    const char *error = NULL;
+    int n = bsearch_run(ctx, pattern, flags, 0, &bsearch_matches, &error);
+    if (n < 0) {
+        bsearch_clear();
+        editor_set_status_msg(ctx, "bsearch: %s", error);
+        return -1;
+    }
+    if (n == 0) {
+        editor_set_status_msg(ctx, "bsearch: No matches in %d buffer%s",
+                              bsearch_matches.buffers,
+                              bsearch_matches.buffers == 1 ? "" : "s");
+        return -1;
+    }
+    return bsearch_jump(ctx, 1);
+}
@@ -0,0 +1,78 @@
+/* bsearch.h - Searching every open buffer (:bsearch and loki.search_buffers())
+ *
+ * A search looks at all open buffers at once: each buffer is a task for a
+ * pool of worker threads, which compile their own copy of a regex (its
+ * DFA fills in as it runs) and share a plain text pattern. The editor
+ * waits for the workers, so nothing can edit a buffer meanwhile and they
+ * read its rows in place; each buffer's search index narrows the rows
+ * read, as for a search in that buffer.
+ *
+ * Matches do not overlap, and come in buffer order (as the tabs show
+ * them), then by position. :bsearch keeps them as a list to step through
+ * with :bsnext and :bsprev, which switch to the match's buffer. The list
+ * is not updated as buffers change: a match in a closed buffer is passed
+ * over, and one past the end of an edited row is moved to the nearest
+ * position that still exists.
+ */
+
+#ifndef LOKI_BSEARCH_H
+#define LOKI_BSEARCH_H
+
+#include "internal.h"
+
+/* Worker threads per search (fewer when there are fewer buffers) */
+#define BSEARCH_MAX_WORKERS 16
+
+/* Matches kept per search; a search stops once it has this many */
+#define BSEARCH_MAX_MATCHES (1 << 20)
+
+/* Flags for bsearch_run() and bsearch_start() */
+#define BSEARCH_LITERAL 1   /* The pattern is plain text, not a regex */
+#define BSEARCH_ICASE 2     /* Ignore case. Without it, :set ignorecase and
+                             * smartcase decide (see search_ignores_case()) */
+#define BSEARCH_CASE 4      /* Match case, whatever the settings say */
+
+/* One match */
+typedef struct BufferMatch {
+    int buffer_id;
+    int row;                /* 0-based */
+    int off;                /* Offset in row->chars */
+    int len;                /* Bytes; 0 for an empty regex match */
+} BufferMatch;
+
+typedef struct BufferMatches {
+    BufferMatch *m;
+    int n, cap;
+    int buffers;            /* Buffers searched */
+} BufferMatches;
+
+/* Search every open buffer for 'pattern' and wait for the result. 'ctx'
+ * is the current buffer, for the case settings; without the buffer list
+ * (headless sessions) it is the one buffer searched, with id -1. At most
+ * 'max' matches are found (0: up to BSEARCH_MAX_MATCHES), the first ones
+ * in buffer order.
+ * Returns the number of matches, or -1 if the pattern does not compile
+ * (*error set). Free 'out' with bsearch_matches_free() either way. */
+int bsearch_run(editor_ctx_t *ctx, const char *pattern, int flags, int max,
+                BufferMatches *out, const char **error);
+
+void bsearch_matches_free(BufferMatches *bm);
+
+/* :bsearch - Search every buffer, keep the matches as the list, and jump
+ * to the first. Returns 0, or -1 on error or no match (status message
+ * set). */
+int bsearch_start(editor_ctx_t *ctx, const char *pattern, int flags);
+
+/* Jump 'step' matches along the list (1 next, -1 previous), wrapping
+ * around; the buffer switched to says where in the status line. Returns
+ * 0, or -1 if the list is empty (status message set). */
+int bsearch_jump(editor_ctx_t *ctx, int step);
+
+/* The list kept by bsearch_start(), and the index of the match last
+ * jumped to (-1 before the first). */
+const BufferMatches *bsearch_list(int *current);
+
+/* Forget the list. */
+void bsearch_clear(void);
+
+#endif /* LOKI_BSEARCH_H */
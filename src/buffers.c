@@ -2,66 +2,287 @@
  *
  * Manages multiple editor contexts (buffers) allowing users to edit
  * multiple files simultaneously with tab-like interface.
+ *
+ * A buffer opened on a file is read the first time it is shown or its
+ * context is asked for. While the rows of loaded buffers take more than
+ * the memory budget, the least recently shown ones give theirs up: a
+ * clean buffer is read again from its file (keeping its undo history if
+ * the file has not changed since), any other one is written to a
+ * snapshot in the temporary directory and read back from there.
+ *
+ * The context lives in a document that any number of buffers can show:
+ * opening a file that is already open, or buffer_create_view(), adds a
+ * buffer on the same document, so its rows, highlighting and undo
+ * history are held once. Each buffer has its own view (cursor, scroll,
+ * mode); the document's context holds the view of the buffer shown last,
+ * and the others are kept aside until theirs is shown. A view shown
+ * again draws its next frame whole: the screen has shown another since.
+ *
+ * buffers_prefetch() reads unread files on a few worker threads ahead of
+ * their buffers being shown: a worker maps and indexes a file, like the
+ * first half of editor_open(), and hands it to the main thread through
+ * the async event queue, which creates the rows. A buffer switched to
+ * while its file is being read waits for that read rather than starting
+ * another.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "buffers.h"
 #include "terminal.h"
 #include "undo.h"
+#include "syntax.h"
+#include "arena.h"
+#include "serialize.h"
+#include "search_index.h"
+#include "loader.h"
+#include "multicursor.h"
+#include "session_file.h"
+#include "word_index.h"
+#include <uv.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Worker threads per buffers_prefetch() */
+#define PREFETCH_MAX_WORKERS 4
 
 /* Forward declarations */
 void editor_insert_row(editor_ctx_t *ctx, int at, char *s, size_t len);
 
-/* Buffer entry - wraps an editor context with metadata */
+struct buffer_entry;
+struct prefetch_job;
+
+/* Document - an editor context and whether its rows are in memory.
+ * Documents are allocated one at a time, so a context stays where it is
+ * for as long as a buffer shows it. */
 typedef struct {
-    editor_ctx_t ctx;       /* Editor context for this buffer */
+    editor_ctx_t ctx;       /* Editor context; ctx.view is viewer's */
+    int refs;               /* Buffers showing this document */
+    struct buffer_entry *viewer;  /* Buffer whose view is in ctx.view */
+    BufferState state;      /* Whether the rows are in memory */
+    unsigned long shown;    /* buffer_state.clock when last made current */
+    unsigned long mark;     /* Counted in this buffers_trim() pass */
+    char *spill_path;       /* BUFFER_SPILLED: snapshot of the rows */
+    struct stat file_stat;  /* BUFFER_EVICTED: the file when evicted */
+    int indexed;            /* Had a search index when its rows went */
+    struct prefetch_job *prefetch;  /* BUFFER_READING: the read */
+} buffer_doc_t;
+
+/* A file read by a prefetch worker. Workers only write 'file', 'index',
+ * 'result' and 'done' (under the run's lock); the rest is the main
+ * thread's. */
+typedef struct prefetch_job {
+    struct prefetch_run *run;
+    buffer_doc_t *doc;      /* NULL once closed */
+    char *path;
+    LoadedFile file;
+    LineIndex index;
+    int result;             /* 0, or -1 if it could not be read */
+    int done;               /* Read, and 'result' set */
+    int taken;              /* Handed to its document, or dropped */
+    int reported;           /* Its completion event was handled */
+} prefetch_job_t;
+
+/* One buffers_prefetch() call: its files, taken in order by the workers */
+typedef struct prefetch_run {
+    struct prefetch_run *next;
+    int id;
+    prefetch_job_t *jobs;
+    int njobs;
+    int next_job;           /* Next to read, guarded by 'lock' */
+    int reported;           /* Completion events handled */
+    uv_mutex_t lock;
+    uv_cond_t cond;         /* Signalled as each job is done */
+    uv_thread_t threads[PREFETCH_MAX_WORKERS];
+    int nthreads;
+    atomic_int cancel;
+} prefetch_run_t;
+
+/* Buffer entry - a document as one tab shows it */
+typedef struct buffer_entry {
+    buffer_doc_t *doc;      /* Document shown */
     int id;                 /* Unique buffer ID */
-    int active;             /* 1 if this slot is in use, 0 if free */
+    int index;              /* Position in buffer_state.list */
     char display_name[64];  /* Cached display name for tabs */
+    EditorView view;        /* This buffer's view while doc->viewer is */
+    ViewFrame frame;        /* another one, and its frame */
+    SessionBuffer *restore; /* Applied when next shown (NULL: nothing) */
 } buffer_entry_t;
 
 /* Global buffer state */
 static struct {
-    buffer_entry_t buffers[MAX_BUFFERS];  /* Array of buffer slots */
-    int current_buffer_id;                /* ID of currently active buffer */
+    buffer_entry_t **list;                /* Open buffers, oldest first */
+    int count, cap;
+    buffer_entry_t **table;               /* ID -> buffer, open addressing */
+    unsigned int mask;                    /* Table size less one */
+    buffer_entry_t *current;              /* Currently active buffer */
     int next_id;                          /* Next ID to assign */
     int initialized;                      /* 1 if buffers_init() was called */
+    unsigned long clock;                  /* Counts buffers made current */
+    unsigned long pass;                   /* Counts buffers_trim() passes */
+    size_t budget;                        /* Row bytes kept loaded, 0: all */
+    int spill_packed;                     /* Spill to packed snapshots */
+    prefetch_run_t *runs;                 /* Prefetches not yet finished */
+    int next_run_id;
 } buffer_state = {0};
 
-/* ======================== Helper Functions ======================== */
+/* ======================== Registry ======================== */
+
+/* IDs are handed out in sequence, and consecutive ones land in
+ * consecutive slots */
+static unsigned int id_slot(int buffer_id) {
+    return (unsigned int)buffer_id & buffer_state.mask;
+}
 
 /* Find buffer entry by ID
  * Returns: Pointer to buffer entry, or NULL if not found */
 static buffer_entry_t *find_buffer(int buffer_id) {
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (buffer_state.buffers[i].active && buffer_state.buffers[i].id == buffer_id) {
-            return &buffer_state.buffers[i];
+    if (!buffer_state.table) return NULL;
+    for (unsigned int i = id_slot(buffer_id);; i = (i + 1) & buffer_state.mask) {
+        buffer_entry_t *buf = buffer_state.table[i];
+        if (!buf) return NULL;
+        if (buf->id == buffer_id) return buf;
+    }
+}
+
+static void table_insert(buffer_entry_t *buf) {
+    unsigned int i = id_slot(buf->id);
+    while (buffer_state.table[i]) i = (i + 1) & buffer_state.mask;
+    buffer_state.table[i] = buf;
+}
+
+/* Remove an entry, moving later ones of the same probe run back so every
+ * lookup still ends at an empty slot */
+static void table_remove(buffer_entry_t *buf) {
+    unsigned int mask = buffer_state.mask;
+    unsigned int i = id_slot(buf->id);
+    while (buffer_state.table[i] != buf) i = (i + 1) & mask;
+    buffer_state.table[i] = NULL;
+    for (unsigned int j = (i + 1) & mask; buffer_state.table[j]; j = (j + 1) & mask) {
+        unsigned int home = id_slot(buffer_state.table[j]->id);
+        /* Stays if its home lies cyclically in (i, j] */
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) continue;
+        buffer_state.table[i] = buffer_state.table[j];
+        buffer_state.table[j] = NULL;
+        i = j;
+    }
+}
+
+/* Make room for one more buffer: the list doubles, and the table is kept
+ * at most half full */
+static void registry_reserve(void) {
+    if (buffer_state.count == buffer_state.cap) {
+        int cap = buffer_state.cap ? buffer_state.cap * 2 : 8;
+        buffer_entry_t **list = realloc(buffer_state.list, sizeof(*list) * (size_t)cap);
+        if (!list) {
+            perror("Out of memory");
+            exit(1);
         }
+        buffer_state.list = list;
+        buffer_state.cap = cap;
     }
-    return NULL;
+    if (buffer_state.table && (unsigned int)buffer_state.count * 2 < buffer_state.mask) return;
+
+    unsigned int size = buffer_state.table ? (buffer_state.mask + 1) * 2 : 16;
+    free(buffer_state.table);
+    buffer_state.table = calloc(size, sizeof(buffer_entry_t *));
+    if (!buffer_state.table) {
+        perror("Out of memory");
+        exit(1);
+    }
+    buffer_state.mask = size - 1;
+    for (int i = 0; i < buffer_state.count; i++) table_insert(buffer_state.list[i]);
+}
+
+/* A new buffer on 'doc', or on a new empty document if NULL, registered
+ * at the end of the list */
+static buffer_entry_t *registry_add(buffer_doc_t *doc) {
+    registry_reserve();
+    buffer_entry_t *buf = calloc(1, sizeof(buffer_entry_t));
+    if (!doc) doc = calloc(1, sizeof(buffer_doc_t));
+    if (!buf || !doc) {
+        perror("Out of memory");
+        exit(1);
+    }
+    if (doc->refs++ == 0) doc->viewer = buf;
+    buf->doc = doc;
+    buf->id = buffer_state.next_id++;
+    buf->index = buffer_state.count;
+    buffer_state.list[buffer_state.count++] = buf;
+    table_insert(buf);
+    return buf;
+}
+
+/* Free a document no buffer shows any more */
+static void doc_free(buffer_doc_t *doc) {
+    /* Note: Don't free lua_host here - it's shared and freed separately */
+    doc->ctx.lua_host = NULL;
+    if (doc->prefetch) doc->prefetch->doc = NULL;
+    editor_ctx_free(&doc->ctx);
+    if (doc->spill_path) {
+        unlink(doc->spill_path);
+        free(doc->spill_path);
+    }
+    free(doc);
 }
 
-/* Find first free buffer slot
- * Returns: Pointer to free slot, or NULL if all slots full */
-static buffer_entry_t *find_free_slot(void) {
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (!buffer_state.buffers[i].active) {
-            return &buffer_state.buffers[i];
+/* Unregister and free an entry, and its document if no other buffer
+ * shows it */
+static void registry_remove(buffer_entry_t *buf) {
+    buffer_doc_t *doc = buf->doc;
+    table_remove(buf);
+    int at = buf->index;
+    memmove(&buffer_state.list[at], &buffer_state.list[at + 1],
+            sizeof(buffer_entry_t *) * (size_t)(buffer_state.count - at - 1));
+    buffer_state.count--;
+    for (int i = at; i < buffer_state.count; i++) buffer_state.list[i]->index = i;
+    /* The view that goes: in the context if this buffer's is shown */
+    multicursor_free(doc->viewer == buf ? &doc->ctx.view : &buf->view);
+    session_buffer_free(buf->restore);
+    free(buf);
+
+    if (--doc->refs == 0) {
+        doc_free(doc);
+    } else if (doc->viewer == buf) {
+        /* Another buffer's view goes into the context */
+        for (int i = 0; i < buffer_state.count; i++) {
+            buffer_entry_t *other = buffer_state.list[i];
+            if (other->doc != doc) continue;
+            doc->ctx.view = other->view;
+            doc->ctx.frame = other->frame;
+            doc->ctx.frame.valid = 0;
+            doc->viewer = other;
+            break;
         }
     }
-    return NULL;
+}
+
+/* Put a buffer's view into its document's context */
+static void show_view(buffer_entry_t *buf) {
+    buffer_doc_t *doc = buf->doc;
+    if (doc->viewer == buf) return;
+    doc->viewer->view = doc->ctx.view;
+    doc->viewer->frame = doc->ctx.frame;
+    doc->ctx.view = buf->view;
+    doc->ctx.frame = buf->frame;
+    doc->ctx.frame.valid = 0;   /* Not what the screen shows any more */
+    doc->viewer = buf;
 }
 
 /* Update display name for buffer */
 static void update_display_name(buffer_entry_t *buf) {
     if (!buf) return;
 
-    if (buf->ctx.model.filename && buf->ctx.model.filename[0] != '\0') {
+    const char *filename = buf->doc->ctx.model.filename;
+    if (filename && filename[0] != '\0') {
         /* Extract basename from path */
-        const char *basename = strrchr(buf->ctx.model.filename, '/');
-        basename = basename ? basename + 1 : buf->ctx.model.filename;
+        const char *basename = strrchr(filename, '/');
+        basename = basename ? basename + 1 : filename;
 
         /* Truncate if too long */
         if (strlen(basename) > 50) {
@@ -74,6 +295,383 @@ static void update_display_name(buffer_entry_t *buf) {
     }
 }
 
+/* ======================== Loading and Eviction ======================== */
+
+/* Bytes held by a document's rows */
+static size_t buffer_memory(const buffer_doc_t *doc) {
+    ArenaStats as;
+    arena_get_stats(doc->ctx.model.arena, &as);
+    return as.chunk_bytes + as.large_bytes +
+           (size_t)doc->ctx.model.rowcap * sizeof(t_erow);
+}
+
+/* editor_open() on the buffer's own file name, which it replaces */
+static int reopen_file(editor_ctx_t *ctx) {
+    char *filename = strdup(ctx->model.filename);
+    if (!filename) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int ret = editor_open(ctx, filename);
+    free(filename);
+    return ret;
+}
+
+/* Rows back from the snapshot they were spilled to, used in place until
+ * they are edited (see editor_model_map_snapshot()), or unpacked with
+ * their highlight from a packed one. The mapping outlives the file's
+ * name, which goes at once. */
+static int load_spill(buffer_doc_t *doc) {
+    editor_ctx_t *ctx = &doc->ctx;
+    int dirty = ctx->model.dirty;
+    if (editor_model_map_snapshot(&ctx->model, doc->spill_path) != 0) return -1;
+    ctx->model.dirty = dirty;
+    editor_model_damage_shift(&ctx->model, 0);
+
+    unlink(doc->spill_path);
+    free(doc->spill_path);
+    doc->spill_path = NULL;
+    if (doc->indexed) search_index_enable(&ctx->model);
+    return 0;
+}
+
+/* ======================== Prefetch ======================== */
+
+static void push_prefetch_event(prefetch_run_t *run, int at) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = PREFETCH_ASYNC_EVENT;
+    ev.data.user.i64[0] = run->id;
+    ev.data.user.i64[1] = at;
+
+    /* Dropped once buffers_free() is waiting for the workers */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&run->cancel)) return;
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void prefetch_worker(void *arg) {
+    prefetch_run_t *run = arg;
+    for (;;) {
+        uv_mutex_lock(&run->lock);
+        int at = run->next_job < run->njobs && !atomic_load(&run->cancel)
+            ? run->next_job++ : -1;
+        uv_mutex_unlock(&run->lock);
+        if (at < 0) return;
+
+        prefetch_job_t *job = &run->jobs[at];
+        LoadedFile file;
+        LineIndex index;
+        int result = -1;
+        if (loader_open(job->path, &file) == 0) {
+            if (loader_index_lines(file.data, file.size, &index) == 0)
+                result = 0;
+            else
+                loader_close(&file);
+        }
+
+        uv_mutex_lock(&run->lock);
+        if (result == 0) {
+            job->file = file;
+            job->index = index;
+        }
+        job->result = result;
+        job->done = 1;
+        uv_cond_broadcast(&run->cond);
+        uv_mutex_unlock(&run->lock);
+        push_prefetch_event(run, at);
+    }
+}
+
+/* Wait for a job's read to be done */
+static void prefetch_wait(prefetch_job_t *job) {
+    prefetch_run_t *run = job->run;
+    uv_mutex_lock(&run->lock);
+    while (!job->done) uv_cond_wait(&run->cond, &run->lock);
+    uv_mutex_unlock(&run->lock);
+}
+
+/* Bytes held by the loaded documents */
+static size_t loaded_memory(void) {
+    size_t total = 0;
+    buffer_state.pass++;
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_doc_t *doc = buffer_state.list[i]->doc;
+        if (doc->state != BUFFER_LOADED || doc->mark == buffer_state.pass) continue;
+        doc->mark = buffer_state.pass;
+        total += buffer_memory(doc);
+    }
+    return total;
+}
+
+/* Hand a finished read to its document, making rows of it. With
+ * 'fit' set, a file that would take the loaded buffers past their budget
+ * is dropped instead, to be read when shown. Returns 0 if the document
+ * has its rows; otherwise it is left BUFFER_UNREAD. */
+static int prefetch_take(prefetch_job_t *job, int fit) {
+    buffer_doc_t *doc = job->doc;
+    int ret = -1;
+    job->taken = 1;
+    if (doc) {
+        doc->prefetch = NULL;
+        doc->state = BUFFER_UNREAD;
+    }
+
+    if (job->result == 0 && doc &&
+        !(fit && buffer_state.budget &&
+          loaded_memory() + job->file.size +
+          (size_t)job->index.count * sizeof(t_erow) > buffer_state.budget)) {
+        ret = editor_open_loaded(&doc->ctx, job->path, &job->file, &job->index);
+        if (ret == 0) doc->state = BUFFER_LOADED;
+    } else if (job->result == 0) {
+        loader_index_free(&job->index);
+        loader_close(&job->file);
+    }
+    return ret;
+}
+
+/* Wait for a run's workers and free it, dropping reads not taken */
+static void prefetch_run_free(prefetch_run_t *run) {
+    atomic_store(&run->cancel, 1);
+    for (int i = 0; i < run->nthreads; i++) uv_thread_join(&run->threads[i]);
+    for (int i = 0; i < run->njobs; i++) {
+        prefetch_job_t *job = &run->jobs[i];
+        if (job->doc && !job->taken) {
+            job->doc->prefetch = NULL;
+            job->doc->state = BUFFER_UNREAD;
+            job->doc = NULL;
+        }
+        if (job->done && !job->taken) prefetch_take(job, 0);
+        free(job->path);
+    }
+    uv_cond_destroy(&run->cond);
+    uv_mutex_destroy(&run->lock);
+    free(run->jobs);
+    free(run);
+}
+
+static void prefetch_event_handler(AsyncEvent *ev, void *ctx) {
+    (void)ctx;
+    prefetch_run_t **link = &buffer_state.runs;
+    while (*link && (*link)->id != ev->data.user.i64[0]) link = &(*link)->next;
+    prefetch_run_t *run = *link;
+    if (!run) return;   /* From before buffers_free() */
+
+    prefetch_job_t *job = &run->jobs[ev->data.user.i64[1]];
+    if (!job->taken) prefetch_take(job, 1);
+    job->reported = 1;
+    if (++run->reported == run->njobs) {
+        *link = run->next;
+        prefetch_run_free(run);
+    }
+}
+
+int buffers_prefetch(void) {
+    if (!buffer_state.initialized || async_queue_global() == NULL) return 0;
+
+    int n = 0;
+    for (int i = 0; i < buffer_state.count; i++)
+        if (buffer_state.list[i]->doc->state == BUFFER_UNREAD) n++;
+    if (n == 0) return 0;
+
+    prefetch_run_t *run = calloc(1, sizeof(*run));
+    if (run) run->jobs = calloc((size_t)n, sizeof(*run->jobs));
+    if (!run || !run->jobs) {
+        perror("Out of memory");
+        exit(1);
+    }
+    run->id = ++buffer_state.next_run_id;
+    /* Each document once, in the order their buffers were opened */
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_doc_t *doc = buffer_state.list[i]->doc;
+        if (doc->state != BUFFER_UNREAD) continue;
+        prefetch_job_t *job = &run->jobs[run->njobs++];
+        job->run = run;
+        job->doc = doc;
+        job->path = strdup(doc->ctx.model.filename);
+        if (!job->path) {
+            perror("Out of memory");
+            exit(1);
+        }
+        doc->prefetch = job;
+        doc->state = BUFFER_READING;
+    }
+    uv_mutex_init(&run->lock);
+    uv_cond_init(&run->cond);
+    atomic_init(&run->cancel, 0);
+
+    if (async_queue_get_handler(NULL, PREFETCH_ASYNC_EVENT) != prefetch_event_handler) {
+        async_queue_set_handler_lane(NULL, PREFETCH_ASYNC_EVENT,
+                                     prefetch_event_handler, ASYNC_LANE_LOW);
+        async_event_set_type_name(PREFETCH_ASYNC_EVENT, "prefetch");
+    }
+
+    int want = run->njobs < PREFETCH_MAX_WORKERS ? run->njobs : PREFETCH_MAX_WORKERS;
+    while (run->nthreads < want &&
+           uv_thread_create(&run->threads[run->nthreads], prefetch_worker, run) == 0)
+        run->nthreads++;
+    if (run->nthreads == 0) {
+        /* No threads: the files are read when shown */
+        prefetch_run_free(run);
+        return 0;
+    }
+    run->next = buffer_state.runs;
+    buffer_state.runs = run;
+    return run->njobs;
+}
+
+/* Read the rows of a buffer that does not have them in memory */
+static void buffer_load(buffer_doc_t *doc) {
+    editor_ctx_t *ctx = &doc->ctx;
+    struct stat st;
+    int ret = -1;
+
+    switch (doc->state) {
+    case BUFFER_LOADED:
+        return;
+    case BUFFER_UNREAD:
+        ret = reopen_file(ctx);
+        break;
+    case BUFFER_READING:
+        /* Far enough along that waiting beats starting over */
+        prefetch_wait(doc->prefetch);
+        ret = prefetch_take(doc->prefetch, 0);
+        if (ret != 0) ret = reopen_file(ctx);
+        break;
+    case BUFFER_EVICTED:
+        if (stat(ctx->model.filename, &st) == 0 &&
+            st.st_mtime == doc->file_stat.st_mtime &&
+            st.st_size == doc->file_stat.st_size) {
+            /* The same contents: the history still applies to them */
+            struct undo_state *undo = ctx->model.undo_state;
+            ctx->model.undo_state = NULL;
+            ret = reopen_file(ctx);
+            ctx->model.undo_state = undo;
+        } else {
+            ret = reopen_file(ctx);
+        }
+        break;
+    case BUFFER_SPILLED:
+        ret = load_spill(doc);
+        if (ret != 0) {
+            editor_set_status_msg(ctx, "Lost buffer contents: can't read %s",
+                                  doc->spill_path);
+            unlink(doc->spill_path);
+            free(doc->spill_path);
+            doc->spill_path = NULL;
+        }
+        break;
+    }
+    doc->state = BUFFER_LOADED;
+
+    if (ret != 0) {
+        /* Show an empty buffer rather than none */
+        undo_clear(ctx);
+        if (ctx->model.numrows == 0) editor_insert_row(ctx, 0, "", 0);
+        ctx->model.dirty = 0;
+    }
+}
+
+/* Free a background document's rows. Returns 0, or -1 if it has to keep
+ * them (nowhere to read them back from). */
+static int buffer_evict(buffer_doc_t *doc) {
+    editor_ctx_t *ctx = &doc->ctx;
+
+    if (ctx->model.dirty || !ctx->model.filename) {
+        const char *dir = getenv("TMPDIR");
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/loki-buffer-XXXXXX",
+                 dir && dir[0] ? dir : "/tmp");
+        int fd = mkstemp(path);
+        if (fd == -1) return -1;
+        close(fd);
+        int saved = buffer_state.spill_packed
+                        ? editor_model_save_packed(&ctx->model, path)
+                        : editor_model_save_snapshot(&ctx->model, path);
+        if (saved != 0) {
+            unlink(path);
+            return -1;
+        }
+        doc->spill_path = strdup(path);
+        if (!doc->spill_path) {
+            perror("Out of memory");
+            exit(1);
+        }
+        doc->state = BUFFER_SPILLED;
+    } else {
+        if (stat(ctx->model.filename, &doc->file_stat) != 0) return -1;
+        doc->state = BUFFER_EVICTED;
+    }
+
+    doc->indexed = ctx->model.search_index != NULL;
+    editor_model_free_rows(&ctx->model);
+    editor_model_use_arena(&ctx->model);
+    return 0;
+}
+
+static int by_shown(const void *a, const void *b) {
+    const buffer_doc_t *x = *(buffer_doc_t *const *)a;
+    const buffer_doc_t *y = *(buffer_doc_t *const *)b;
+    return x->shown < y->shown ? -1 : x->shown > y->shown;
+}
+
+int buffers_trim(void) {
+    if (!buffer_state.initialized || buffer_state.budget == 0) return 0;
+
+    size_t total = loaded_memory();
+    int n = 0;
+    buffer_doc_t **order = malloc(sizeof(*order) * (size_t)buffer_state.count);
+    if (!order) {
+        perror("Out of memory");
+        exit(1);
+    }
+    /* Each document once, however many buffers show it */
+    buffer_state.pass++;
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_doc_t *doc = buffer_state.list[i]->doc;
+        if (doc->state != BUFFER_LOADED || doc->mark == buffer_state.pass) continue;
+        doc->mark = buffer_state.pass;
+        if (!buffer_state.current || doc != buffer_state.current->doc) order[n++] = doc;
+    }
+
+    /* Least recently shown first; the current buffer stays */
+    qsort(order, (size_t)n, sizeof(*order), by_shown);
+    int evicted = 0;
+    for (int i = 0; i < n && total > buffer_state.budget; i++) {
+        size_t held = buffer_memory(order[i]);
+        if (buffer_evict(order[i]) == 0) {
+            total -= held;
+            evicted++;
+        }
+    }
+    free(order);
+    return evicted;
+}
+
+/* Show a buffer: read it if need be, then let older ones go */
+static void make_current(buffer_entry_t *buf) {
+    editor_ctx_t *ctx = &buf->doc->ctx;
+    buffer_load(buf->doc);
+    show_view(buf);
+    /* First shown since a session was restored */
+    if (buf->restore) {
+        SessionBuffer *restore = buf->restore;
+        buf->restore = NULL;
+        session_file_apply(ctx, restore);
+        session_buffer_free(restore);
+    }
+    /* Rows may have gone while the view was aside */
+    if (ctx->view.rowoff + ctx->view.cy >= ctx->model.numrows) {
+        ctx->view.rowoff = ctx->view.coloff = 0;
+        ctx->view.cx = ctx->view.cy = 0;
+    }
+    buffer_state.current = buf;
+    buf->doc->shown = ++buffer_state.clock;
+    buffers_trim();
+}
+
 /* ======================== Initialization ======================== */
 
 int buffers_init(editor_ctx_t *initial_ctx) {
@@ -81,16 +679,14 @@ int buffers_init(editor_ctx_t *initial_ctx) {
         return -1;  /* Already initialized */
     }
 
-    /* Initialize buffer array */
-    memset(buffer_state.buffers, 0, sizeof(buffer_state.buffers));
-    buffer_state.current_buffer_id = -1;
+    buffer_state.current = NULL;
     buffer_state.next_id = 1;
+    buffer_state.budget = BUFFERS_DEFAULT_BUDGET;
     buffer_state.initialized = 1;
 
     /* Create first buffer using the provided context */
-    buffer_entry_t *first = &buffer_state.buffers[0];
-    first->active = 1;
-    first->id = buffer_state.next_id++;
+    buffer_entry_t *first_buf = registry_add(NULL);
+    buffer_doc_t *first = first_buf->doc;
 
     /* Initialize fresh context and copy only essential state from initial_ctx */
     editor_ctx_init(&first->ctx);
@@ -101,6 +697,7 @@ int buffers_init(editor_ctx_t *initial_ctx) {
     first->ctx.view.screenrows_total = initial_ctx->view.screenrows_total;
     first->ctx.lua_host = initial_ctx->lua_host;  /* Share Lua host across buffers */
     memcpy(first->ctx.view.colors, initial_ctx->view.colors, sizeof(first->ctx.view.colors));
+    syntax_colors_changed(&first->ctx);
 
     /* Copy display settings */
     first->ctx.view.line_numbers = initial_ctx->view.line_numbers;
@@ -110,8 +707,41 @@ int buffers_init(editor_ctx_t *initial_ctx) {
      * double-free when initial_ctx is cleaned up. */
     first->ctx.model.numrows = initial_ctx->model.numrows;
     first->ctx.model.row = initial_ctx->model.row;
+    first->ctx.model.rowcap = initial_ctx->model.rowcap;
+    first->ctx.model.arena = initial_ctx->model.arena;
+    first->ctx.model.row_map = initial_ctx->model.row_map;
+    first->ctx.model.hl_stale_from = initial_ctx->model.hl_stale_from;
+    first->ctx.model.fences = initial_ctx->model.fences;
+    initial_ctx->model.fences = NULL;
+    first->ctx.model.search_index = initial_ctx->model.search_index;
+    initial_ctx->model.search_index = NULL;
+    first->ctx.model.decor = initial_ctx->model.decor;
+    initial_ctx->model.decor = NULL;
+    first->ctx.model.marks = initial_ctx->model.marks;
+    initial_ctx->model.marks = NULL;
+    first->ctx.model.folds = initial_ctx->model.folds;
+    initial_ctx->model.folds = NULL;
+    first->ctx.model.wrap = initial_ctx->model.wrap;
+    initial_ctx->model.wrap = NULL;
+    first->ctx.model.utf8_cols = initial_ctx->model.utf8_cols;
+    initial_ctx->model.utf8_cols = NULL;
+    first->ctx.model.lazy = initial_ctx->model.lazy;
+    initial_ctx->model.lazy = NULL;
+    first->ctx.model.follow = initial_ctx->model.follow;
+    initial_ctx->model.follow = NULL;
+    first->ctx.model.watch = initial_ctx->model.watch;
+    initial_ctx->model.watch = NULL;
+    /* Its word index watches the model it was built for: built again
+     * for the buffer's when first needed */
+    word_index_free(&initial_ctx->model);
+    first->ctx.model.damage_gen = initial_ctx->model.damage_gen;
+    first->ctx.model.edit_gen = initial_ctx->model.edit_gen;
     initial_ctx->model.row = NULL;  /* Transfer ownership */
     initial_ctx->model.numrows = 0;
+    initial_ctx->model.rowcap = 0;
+    initial_ctx->model.arena = NULL;
+    initial_ctx->model.row_map = NULL;
+    editor_model_use_arena(&first->ctx.model);
 
     first->ctx.model.filename = initial_ctx->model.filename;
     initial_ctx->model.filename = NULL;  /* Transfer ownership */
@@ -125,8 +755,9 @@ int buffers_init(editor_ctx_t *initial_ctx) {
     first->ctx.view.rowoff = initial_ctx->view.rowoff;
     first->ctx.view.coloff = initial_ctx->view.coloff;
 
-    update_display_name(first);
-    buffer_state.current_buffer_id = first->id;
+    update_display_name(first_buf);
+    buffer_state.current = first_buf;
+    first->shown = ++buffer_state.clock;
 
     return 0;
 }
@@ -134,71 +765,93 @@ int buffers_init(editor_ctx_t *initial_ctx) {
 void buffers_free(void) {
     if (!buffer_state.initialized) return;
 
-    /* Free all active buffers */
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (buffer_state.buffers[i].active) {
-            /* Note: Don't free lua_host here - it's shared and freed separately */
-            buffer_state.buffers[i].ctx.lua_host = NULL;
-            editor_ctx_free(&buffer_state.buffers[i].ctx);
-            buffer_state.buffers[i].active = 0;
-        }
+    /* Reads still going are waited for, and dropped */
+    while (buffer_state.runs) {
+        prefetch_run_t *run = buffer_state.runs;
+        buffer_state.runs = run->next;
+        prefetch_run_free(run);
     }
 
-    /* Reset buffer manager state completely */
-    buffer_state.initialized = 0;
-    buffer_state.current_buffer_id = 0;
+    /* Free all open buffers, and their documents */
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_entry_t *buf = buffer_state.list[i];
+        if (--buf->doc->refs == 0) doc_free(buf->doc);
+        free(buf);
+    }
+    free(buffer_state.list);
+    free(buffer_state.table);
+
+    /* Reset buffer manager state completely. Run IDs go on, so events
+     * still queued for old runs find none. */
+    int next_run_id = buffer_state.next_run_id;
+    memset(&buffer_state, 0, sizeof(buffer_state));
     buffer_state.next_id = 1;
+    buffer_state.next_run_id = next_run_id;
 }
 
 /* ======================== Buffer Operations ======================== */
 
+/* A buffer showing the file 'st' describes, or NULL */
+static buffer_entry_t *find_file(const struct stat *st) {
+    struct stat other;
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_entry_t *buf = buffer_state.list[i];
+        const char *filename = buf->doc->ctx.model.filename;
+        if (filename && stat(filename, &other) == 0 &&
+            other.st_dev == st->st_dev && other.st_ino == st->st_ino)
+            return buf;
+    }
+    return NULL;
+}
+
 int buffer_create(const char *filename) {
     if (!buffer_state.initialized) return -1;
 
+    /* A file already open gets another buffer on its document */
+    struct stat st;
+    if (filename) {
+        if (stat(filename, &st) != 0) return -1;  /* No such file */
+        buffer_entry_t *open = find_file(&st);
+        if (open) return buffer_create_view(open->id);
+    }
+
     /* Get current buffer context to copy terminal state BEFORE creating new one */
     editor_ctx_t *template_ctx = buffer_get_current();
 
-    /* Find free slot */
-    buffer_entry_t *buf = find_free_slot();
-    if (!buf) {
-        return -1;  /* No free slots */
-    }
-
-    /* Initialize new buffer */
-    buf->active = 1;
-    buf->id = buffer_state.next_id++;
+    buffer_entry_t *buf = registry_add(NULL);
+    buffer_doc_t *doc = buf->doc;
 
     /* Initialize editor context */
-    editor_ctx_init(&buf->ctx);
+    editor_ctx_init(&doc->ctx);
+    editor_model_use_arena(&doc->ctx.model);
 
     /* Copy display state from template buffer (rawmode now in TerminalHost) */
     if (template_ctx) {
-        buf->ctx.view.screencols = template_ctx->view.screencols;
-        buf->ctx.view.screenrows = template_ctx->view.screenrows;
-        buf->ctx.view.screenrows_total = template_ctx->view.screenrows_total;
-        buf->ctx.lua_host = template_ctx->lua_host;  /* Share Lua host */
+        doc->ctx.view.screencols = template_ctx->view.screencols;
+        doc->ctx.view.screenrows = template_ctx->view.screenrows;
+        doc->ctx.view.screenrows_total = template_ctx->view.screenrows_total;
+        doc->ctx.lua_host = template_ctx->lua_host;  /* Share Lua host */
         /* Copy color scheme */
-        memcpy(buf->ctx.view.colors, template_ctx->view.colors, sizeof(buf->ctx.view.colors));
+        memcpy(doc->ctx.view.colors, template_ctx->view.colors, sizeof(doc->ctx.view.colors));
+        syntax_colors_changed(&doc->ctx);
         /* Copy display settings */
-        buf->ctx.view.line_numbers = template_ctx->view.line_numbers;
+        doc->ctx.view.line_numbers = template_ctx->view.line_numbers;
     }
 
-    /* Initialize undo system for new buffer */
-    undo_init(&buf->ctx, 1000, 10 * 1024 * 1024);  /* 1000 ops, 10MB limit */
-
-    /* Open file if provided */
+    /* A file is only read when the buffer is first shown */
     if (filename) {
-        if (editor_open(&buf->ctx, (char *)filename) != 0) {
-            /* Failed to open file - clean up */
-            editor_ctx_free(&buf->ctx);
-            buf->active = 0;
-            return -1;
+        doc->ctx.model.filename = strdup(filename);
+        if (!doc->ctx.model.filename) {
+            perror("Out of memory");
+            exit(1);
         }
+        doc->state = BUFFER_UNREAD;
+        syntax_select_for_filename(&doc->ctx, doc->ctx.model.filename);
     } else {
         /* Empty buffer - insert one empty row so it displays properly */
-        editor_insert_row(&buf->ctx, 0, "", 0);
+        editor_insert_row(&doc->ctx, 0, "", 0);
         /* Reset dirty flag - empty buffer shouldn't be marked as modified */
-        buf->ctx.model.dirty = 0;
+        doc->ctx.model.dirty = 0;
     }
 
     update_display_name(buf);
@@ -206,35 +859,47 @@ int buffer_create(const char *filename) {
     return buf->id;
 }
 
+int buffer_create_view(int buffer_id) {
+    if (!buffer_state.initialized) return -1;
+
+    buffer_entry_t *of = find_buffer(buffer_id);
+    if (!of) return -1;
+
+    /* Starts where that buffer's view is, with no frame drawn yet */
+    buffer_doc_t *doc = of->doc;
+    buffer_entry_t *buf = registry_add(doc);
+    buf->view = of == doc->viewer ? doc->ctx.view : of->view;
+    buf->view.cursors = NULL;       /* Only the main cursor comes along */
+    buf->view.cursor_count = buf->view.cursor_cap = 0;
+    memset(&buf->frame, 0, sizeof(buf->frame));
+    update_display_name(buf);
+
+    return buf->id;
+}
+
 int buffer_close(int buffer_id, int force) {
     if (!buffer_state.initialized) return -1;
 
     buffer_entry_t *buf = find_buffer(buffer_id);
     if (!buf) return -1;
 
-    /* Check for unsaved changes */
-    if (!force && buf->ctx.model.dirty) {
+    /* Check for unsaved changes, unless another buffer shows them */
+    if (!force && buf->doc->refs == 1 && buf->doc->ctx.model.dirty) {
         return 1;  /* Has unsaved changes */
     }
 
     /* Can't close last buffer */
-    if (buffer_count() <= 1) {
+    if (buffer_state.count <= 1) {
         return -1;
     }
 
-    /* If closing current buffer, switch to another first */
-    if (buffer_id == buffer_state.current_buffer_id) {
-        /* Try to switch to next buffer */
-        int next_id = buffer_next();
-        if (next_id == buffer_id) {
-            /* Only one buffer left - can't close */
-            return -1;
-        }
+    /* If closing current buffer, switch to the next one first */
+    if (buf == buffer_state.current) {
+        buffer_next();
     }
 
     /* Free buffer resources */
-    editor_ctx_free(&buf->ctx);
-    buf->active = 0;
+    registry_remove(buf);
 
     return 0;
 }
@@ -245,121 +910,113 @@ int buffer_switch(int buffer_id) {
     buffer_entry_t *buf = find_buffer(buffer_id);
     if (!buf) return -1;
 
-    /* Save current state before switching */
-    buffers_save_current_state();
-
-    /* Switch to new buffer */
-    buffer_state.current_buffer_id = buffer_id;
-
-    /* Restore new buffer state */
-    buffers_restore_state(&buf->ctx);
-
+    /* Contexts stay in their documents; only a view may be swapped */
+    make_current(buf);
     return 0;
 }
 
-int buffer_next(void) {
-    if (!buffer_state.initialized || buffer_count() == 0) return -1;
-
-    int found_current = 0;
+/* Switch to the buffer 'step' places from the current one, wrapping */
+static int buffer_step(int step) {
+    if (!buffer_state.initialized || buffer_state.count == 0) return -1;
 
-    /* Find next active buffer after current */
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (!buffer_state.buffers[i].active) continue;
+    int at = buffer_state.current ? buffer_state.current->index : 0;
+    make_current(buffer_state.list[(at + step + buffer_state.count) % buffer_state.count]);
+    return buffer_state.current->id;
+}
 
-        if (found_current) {
-            /* Found next buffer */
-            buffer_switch(buffer_state.buffers[i].id);
-            return buffer_state.buffers[i].id;
-        }
+int buffer_next(void) {
+    return buffer_step(1);
+}
 
-        if (buffer_state.buffers[i].id == buffer_state.current_buffer_id) {
-            found_current = 1;
-        }
-    }
+int buffer_prev(void) {
+    return buffer_step(-1);
+}
 
-    /* Wrap around to first buffer */
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (buffer_state.buffers[i].active) {
-            buffer_switch(buffer_state.buffers[i].id);
-            return buffer_state.buffers[i].id;
-        }
-    }
+/* ======================== Query Functions ======================== */
 
-    return -1;
+editor_ctx_t *buffer_get_current(void) {
+    if (!buffer_state.initialized || !buffer_state.current) return NULL;
+    return &buffer_state.current->doc->ctx;
 }
 
-int buffer_prev(void) {
-    if (!buffer_state.initialized || buffer_count() == 0) return -1;
-
-    int prev_id = -1;
+editor_ctx_t *buffer_get(int buffer_id) {
+    if (!buffer_state.initialized) return NULL;
 
-    /* Find previous active buffer before current */
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (!buffer_state.buffers[i].active) continue;
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    if (!buf) return NULL;
+    buffer_load(buf->doc);
+    return &buf->doc->ctx;
+}
 
-        if (buffer_state.buffers[i].id == buffer_state.current_buffer_id) {
-            /* Found current, prev_id has previous */
-            if (prev_id != -1) {
-                buffer_switch(prev_id);
-                return prev_id;
-            }
-            break;
-        }
+editor_ctx_t *buffer_peek(int buffer_id, const EditorView **view) {
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    if (!buf) return NULL;
+    *view = buf->doc->viewer == buf ? &buf->doc->ctx.view : &buf->view;
+    return &buf->doc->ctx;
+}
 
-        prev_id = buffer_state.buffers[i].id;
+void buffer_set_restore(int buffer_id, SessionBuffer *restore) {
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    if (!buf) {
+        session_buffer_free(restore);
+        return;
     }
+    session_buffer_free(buf->restore);
+    buf->restore = restore;
+}
 
-    /* Wrap around to last buffer */
-    for (int i = MAX_BUFFERS - 1; i >= 0; i--) {
-        if (buffer_state.buffers[i].active) {
-            buffer_switch(buffer_state.buffers[i].id);
-            return buffer_state.buffers[i].id;
-        }
-    }
+const SessionBuffer *buffer_get_restore(int buffer_id) {
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    return buf ? buf->restore : NULL;
+}
 
-    return -1;
+BufferState buffer_get_state(int buffer_id) {
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    return buf ? buf->doc->state : BUFFER_LOADED;
 }
 
-/* ======================== Query Functions ======================== */
+int buffer_view_count(int buffer_id) {
+    buffer_entry_t *buf = find_buffer(buffer_id);
+    return buf ? buf->doc->refs : 0;
+}
 
-editor_ctx_t *buffer_get_current(void) {
-    if (!buffer_state.initialized) return NULL;
+void buffers_set_memory_budget(size_t bytes) {
+    buffer_state.budget = bytes;
+    buffers_trim();
+}
 
-    buffer_entry_t *buf = find_buffer(buffer_state.current_buffer_id);
-    return buf ? &buf->ctx : NULL;
+size_t buffers_get_memory_budget(void) {
+    return buffer_state.budget;
 }
 
-editor_ctx_t *buffer_get(int buffer_id) {
-    if (!buffer_state.initialized) return NULL;
+void buffers_set_spill_packed(int packed) {
+    buffer_state.spill_packed = packed != 0;
+}
 
-    buffer_entry_t *buf = find_buffer(buffer_id);
-    return buf ? &buf->ctx : NULL;
+int buffers_get_spill_packed(void) {
+    return buffer_state.spill_packed;
 }
 
 int buffer_get_current_id(void) {
-    return buffer_state.initialized ? buffer_state.current_buffer_id : -1;
+    if (!buffer_state.initialized || !buffer_state.current) return -1;
+    return buffer_state.current->id;
 }
 
 int buffer_count(void) {
-    if (!buffer_state.initialized) return 0;
+    return buffer_state.initialized ? buffer_state.count : 0;
+}
 
-    int count = 0;
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (buffer_state.buffers[i].active) {
-            count++;
-        }
-    }
-    return count;
+int buffer_get_id_at(int index) {
+    if (!buffer_state.initialized || index < 0 || index >= buffer_state.count) return -1;
+    return buffer_state.list[index]->id;
 }
 
-int buffer_get_list(int *ids) {
+int buffer_get_list(int *ids, int max) {
     if (!buffer_state.initialized || !ids) return 0;
 
     int count = 0;
-    for (int i = 0; i < MAX_BUFFERS && count < MAX_BUFFERS; i++) {
-        if (buffer_state.buffers[i].active) {
-            ids[count++] = buffer_state.buffers[i].id;
-        }
+    for (int i = 0; i < buffer_state.count && count < max; i++) {
+        ids[count++] = buffer_state.list[i]->id;
     }
     return count;
 }
@@ -372,29 +1029,19 @@ const char *buffer_get_display_name(int buffer_id) {
 int buffer_is_modified(int buffer_id) {
     buffer_entry_t *buf = find_buffer(buffer_id);
     if (!buf) return -1;
-    return buf->ctx.model.dirty ? 1 : 0;
-}
-
-/* ======================== State Management ======================== */
-
-void buffers_save_current_state(void) {
-    /* Current state is already in the buffer context - nothing to do.
-     * The editor context contains all necessary state (cursor position, etc.)
-     * This function is here for future extensions if needed. */
-}
-
-void buffers_restore_state(editor_ctx_t *ctx) {
-    /* State is restored by switching the active context pointer.
-     * This function is here for future extensions if needed. */
-    (void)ctx;  /* Unused for now */
+    return buf->doc->ctx.model.dirty ? 1 : 0;
 }
 
 /* ======================== Utility Functions ======================== */
 
 void buffer_update_display_name(int buffer_id) {
     buffer_entry_t *buf = find_buffer(buffer_id);
-    if (buf) {
-        update_display_name(buf);
+    if (!buf) return;
+
+    /* Every buffer on the document shows the new name */
+    for (int i = 0; i < buffer_state.count; i++) {
+        if (buffer_state.list[i]->doc == buf->doc)
+            update_display_name(buffer_state.list[i]);
     }
 }
 
@@ -411,12 +1058,10 @@ void buffers_render_tabs(struct abuf *ab, int max_width) {
 
     (void)max_width;  /* Not needed for simple numeric tabs */
 
-    /* Render each active buffer as a simple numbered tab: [1] [2] [3] */
-    for (int i = 0; i < MAX_BUFFERS; i++) {
-        if (!buffer_state.buffers[i].active) continue;
-
-        buffer_entry_t *buf = &buffer_state.buffers[i];
-        int is_current = (buf->id == buffer_state.current_buffer_id);
+    /* Render each open buffer as a simple numbered tab: [1] [2] [3] */
+    for (int i = 0; i < buffer_state.count; i++) {
+        buffer_entry_t *buf = buffer_state.list[i];
+        int is_current = (buf == buffer_state.current);
 
         /* Highlight current tab with reverse video */
         if (is_current) {
@@ -424,7 +1069,7 @@ void buffers_render_tabs(struct abuf *ab, int max_width) {
         }
 
         /* Simple tab format: [N] where N is the buffer ID */
-        char tab_str[8];
+        char tab_str[16];
         snprintf(tab_str, sizeof(tab_str), "[%d]", buf->id);
         terminal_buffer_append(ab, tab_str, strlen(tab_str));
 
@@ -460,22 +1105,20 @@ int buffers_get_tab_info(char ***tabs, int *tab_count, int *active_tab) {
 
     int idx = 0;
     int active_idx = 0;
-    for (int i = 0; i < MAX_BUFFERS && idx < count; i++) {
-        if (!buffer_state.buffers[i].active) continue;
-
-        buffer_entry_t *buf = &buffer_state.buffers[i];
+    for (int i = 0; i < count; i++) {
+        buffer_entry_t *buf = buffer_state.list[i];
 
         /* Create label: "[N]" format */
-        labels[idx] = malloc(8);
+        labels[idx] = malloc(16);
         if (!labels[idx]) {
             /* Cleanup on failure */
             for (int j = 0; j < idx; j++) free(labels[j]);
             free(labels);
             return -1;
         }
-        snprintf(labels[idx], 8, "[%d]", buf->id);
+        snprintf(labels[idx], 16, "[%d]", buf->id);
 
-        if (buf->id == buffer_state.current_buffer_id) {
+        if (buf == buffer_state.current) {
             active_idx = idx;
         }
         idx++;
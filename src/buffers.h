@@ -9,6 +9,21 @@
  * - Close buffers (with unsaved changes warning)
  * - Tab-like status bar display showing all open buffers
  *
+ * Buffers are kept in the order they were opened, each in its own
+ * allocation, with a hash table from ID to buffer: lookups and switching
+ * take constant time however many are open, and there is no fixed limit.
+ *
+ * A buffer shows a document: opening a file that is already open, or
+ * buffer_create_view(), adds a buffer with its own cursor and scroll
+ * position on the same rows, highlighting and undo history.
+ *
+ * Files are read when their buffer is first shown or asked for, and
+ * background buffers give up their rows while the loaded ones hold more
+ * than a memory budget (see buffers_set_memory_budget()).
+ * buffers_prefetch() reads them on worker threads beforehand, so that
+ * opening many files costs no more up front than opening one, and
+ * switching to them does not wait for the disk.
+ *
  * Keybindings:
  * - Ctrl-T: Create new empty buffer
  * - Ctrl-W: Close current buffer
@@ -21,12 +36,27 @@
 
 #include "loki/core.h"
 #include "internal.h"
-
-/* Maximum number of simultaneous buffers */
-#define MAX_BUFFERS 16
+#include "async_queue.h"
 
 /* Buffer state - opaque structure defined in loki_buffers.c */
 struct buffer_state;
+struct SessionBuffer;
+
+/* Async event saying a prefetched file has been read (data.user.i64[0] =
+ * run id, i64[1] = file) */
+#define PREFETCH_ASYNC_EVENT (ASYNC_EVENT_USER + 3)
+
+/* Row bytes loaded buffers may hold before background ones are evicted */
+#define BUFFERS_DEFAULT_BUDGET ((size_t)256 * 1024 * 1024)
+
+/* Whether a buffer's rows are in memory */
+typedef enum {
+    BUFFER_LOADED = 0,      /* Rows in memory */
+    BUFFER_UNREAD,          /* Created on a file not read yet */
+    BUFFER_READING,         /* Being read by buffers_prefetch() */
+    BUFFER_EVICTED,         /* Clean: read again from its file */
+    BUFFER_SPILLED          /* Modified or unnamed: read from a snapshot */
+} BufferState;
 
 /* ======================== Public API ======================== */
 
@@ -40,13 +70,22 @@ int buffers_init(editor_ctx_t *initial_ctx);
 void buffers_free(void);
 
 /* Create a new buffer
- * filename: File to open (NULL for empty buffer)
- * Returns: Buffer ID on success, -1 on failure */
+ * filename: File to open (NULL for empty buffer). It is read when the
+ *           buffer is first switched to or got with buffer_get(). If a
+ *           buffer shows it already, the new one shares its document.
+ * Returns: Buffer ID on success, -1 on failure (no such file) */
 int buffer_create(const char *filename);
 
-/* Close a buffer by ID
+/* Create a new buffer on the same document as another, with its own view
+ * starting where that buffer's is
+ * buffer_id: ID of buffer to view again
+ * Returns: Buffer ID on success, -1 if buffer not found */
+int buffer_create_view(int buffer_id);
+
+/* Close a buffer by ID. Its document goes with the last buffer showing it.
  * buffer_id: ID of buffer to close
- * force: If 0, warn about unsaved changes; if 1, close regardless
+ * force: If 0, warn about unsaved changes no other buffer shows; if 1,
+ *        close regardless
  * Returns: 0 on success, -1 if buffer not found, 1 if unsaved changes and not forced */
 int buffer_close(int buffer_id, int force);
 
@@ -67,11 +106,60 @@ int buffer_prev(void);
  * Returns: Pointer to current editor context, or NULL if no buffers */
 editor_ctx_t *buffer_get_current(void);
 
-/* Get buffer context by ID
+/* Get buffer context by ID, reading its rows if they are not in memory
  * buffer_id: ID of buffer to get
- * Returns: Pointer to editor context, or NULL if not found */
+ * Returns: Pointer to editor context, or NULL if not found. Buffers on
+ *          one document share it; its view is the one shown last. The
+ *          rows of a background buffer may be evicted by the next
+ *          buffer_switch(), buffer_next/prev() or buffers_trim(). */
 editor_ctx_t *buffer_get(int buffer_id);
 
+/* Read the files of all buffers not read yet on worker threads. Each
+ * becomes BUFFER_LOADED when its PREFETCH_ASYNC_EVENT is handled, unless
+ * that would take the loaded buffers past the memory budget; switching
+ * to one still being read waits for it. Does nothing without an async
+ * event queue (the files are read when shown).
+ * Returns: Number of files being read */
+int buffers_prefetch(void);
+
+/* Get the number of buffers on a buffer's document
+ * Returns: 1 or more, or 0 if buffer not found */
+int buffer_view_count(int buffer_id);
+
+/* Get whether a buffer's rows are in memory, without reading them
+ * Returns: BUFFER_LOADED if so (or if there is no such buffer) */
+BufferState buffer_get_state(int buffer_id);
+
+/* Get a buffer's context without reading its rows, and its view
+ * Returns: The context of its document (rows possibly not in memory), or
+ *          NULL if not found; *view is the buffer's own view */
+editor_ctx_t *buffer_peek(int buffer_id, const EditorView **view);
+
+/* Have a session's state for a buffer applied when it is next shown (see
+ * session_file.h); the buffer takes 'restore' over */
+void buffer_set_restore(int buffer_id, struct SessionBuffer *restore);
+
+/* Get what is to be applied to a buffer when it is next shown
+ * Returns: It, or NULL if nothing (or no such buffer) */
+const struct SessionBuffer *buffer_get_restore(int buffer_id);
+
+/* Set the memory budget for the rows of loaded buffers, and trim to it
+ * bytes: Budget in bytes, 0 for no limit (default BUFFERS_DEFAULT_BUDGET) */
+void buffers_set_memory_budget(size_t bytes);
+
+/* Get the memory budget set with buffers_set_memory_budget() */
+size_t buffers_get_memory_budget(void);
+
+/* Spill modified buffers to packed snapshots (smaller, and their
+ * highlight comes back with them) rather than mappable ones (default) */
+void buffers_set_spill_packed(int packed);
+int buffers_get_spill_packed(void);
+
+/* Evict background buffers, least recently shown first, until the loaded
+ * ones fit the budget. The current buffer is never evicted.
+ * Returns: Number of buffers evicted */
+int buffers_trim(void);
+
 /* Get current buffer ID
  * Returns: Current buffer ID, or -1 if no buffers */
 int buffer_get_current_id(void);
@@ -80,10 +168,16 @@ int buffer_get_current_id(void);
  * Returns: Number of open buffers */
 int buffer_count(void);
 
+/* Get buffer ID by position, in the order buffers were opened
+ * index: 0 for the first buffer, up to buffer_count() - 1
+ * Returns: Buffer ID, or -1 if there is no buffer at that position */
+int buffer_get_id_at(int index);
+
 /* Get list of buffer IDs
- * ids: Array to fill with buffer IDs (must be at least MAX_BUFFERS in size)
- * Returns: Number of buffers (IDs filled in array) */
-int buffer_get_list(int *ids);
+ * ids: Array to fill with buffer IDs
+ * max: Room in ids (buffer_count() for all of them)
+ * Returns: Number of IDs filled in array */
+int buffer_get_list(int *ids, int max);
 
 /* Get buffer display name (filename or "[No Name]")
  * buffer_id: ID of buffer
@@ -102,14 +196,6 @@ int buffer_is_modified(int buffer_id);
  * Where * indicates modified buffer and highlighted tab is current */
 void buffers_render_tabs(struct abuf *ab, int max_width);
 
-/* Save current buffer context state
- * Called before switching buffers to preserve cursor position, etc. */
-void buffers_save_current_state(void);
-
-/* Restore buffer context state
- * Called after switching buffers to restore cursor position, etc. */
-void buffers_restore_state(editor_ctx_t *ctx);
-
 /* Update buffer display name (call after changing filename)
  * buffer_id: ID of buffer to update
  * This refreshes the cached display name based on the current filename */
@@ -0,0 +1,283 @@
+/* changes.c - Edits of a buffer, batched for plugins
+ *
+ * See changes.h for an overview. Each watch keeps its own spans, as LSP
+ * sync does (lsp.c): the rows of the buffer changed since the watch was
+ * last called, neither overlapping nor touching, each knowing how many
+ * rows it replaced.
+ */
+
+#include "changes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct ChangeSpan {
+    int first, last;            /* Rows it holds now */
+    int old_count;              /* Rows it replaced */
+    unsigned long gen;          /* Edit number of its last edit */
+} ChangeSpan;
+
+typedef struct ChangeWatch {
+    int id;
+    int interval_ms;
+    ChangeFn fn;
+    void (*release)(void *opaque);
+    void *opaque;
+    ChangeSpan spans[CHANGES_MAX_SPANS];
+    int nspans;
+    int whole;                  /* The rows were all replaced */
+    unsigned long whole_gen;
+    uint64_t due;               /* When the batch goes (0: not set yet) */
+    unsigned long ticked;       /* changes_tick() call last delivered in */
+    int held;                   /* Collecting only (changes_hold()) */
+    struct ChangeWatch *next;
+} ChangeWatch;
+
+typedef struct ChangeLog {
+    EditorModel *model;
+    ChangeWatch *watches;
+    unsigned long gen;          /* Edits noted */
+    struct ChangeLog *next;     /* In 'logs' */
+} ChangeLog;
+
+static ChangeLog *logs = NULL;
+static int next_id = 1;
+static unsigned long ticks = 0;
+
+int changes_watch(EditorModel *model, int interval_ms, ChangeFn fn,
+                  void (*release)(void *opaque), void *opaque) {
+    ChangeLog *log = model->changes;
+    if (log == NULL) {
+        log = model->changes = calloc(1, sizeof(ChangeLog));
+        if (log == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        log->model = model;
+        log->next = logs;
+        logs = log;
+    }
+    ChangeWatch *w = calloc(1, sizeof(ChangeWatch));
+    if (w == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    w->id = next_id++;
+    w->interval_ms = interval_ms > 0 ? interval_ms : 0;
+    w->fn = fn;
+    w->release = release;
+    w->opaque = opaque;
+    w->next = log->watches;
+    log->watches = w;
+    return w->id;
+}
+
+static void watch_free(ChangeWatch *w) {
+    if (w->release) w->release(w->opaque);
+    free(w);
+}
+
+/* Drop a log with no watches left: edits of its buffer go unnoted */
+static void log_drop(ChangeLog *log) {
+    for (ChangeLog **p = &logs; *p; p = &(*p)->next) {
+        if (*p == log) {
+            *p = log->next;
+            break;
+        }
+    }
+    log->model->changes = NULL;
+    free(log);
+}
+
+/* The watch 'id', and its log in *logp */
+static ChangeWatch *find_watch(int id, ChangeLog **logp) {
+    for (ChangeLog *log = logs; log; log = log->next) {
+        for (ChangeWatch *w = log->watches; w; w = w->next) {
+            if (w->id != id) continue;
+            *logp = log;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+int changes_unwatch(int id) {
+    for (ChangeLog *log = logs; log; log = log->next) {
+        for (ChangeWatch **p = &log->watches; *p; p = &(*p)->next) {
+            ChangeWatch *w = *p;
+            if (w->id != id) continue;
+            *p = w->next;
+            if (log->watches == NULL) log_drop(log);
+            watch_free(w);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void changes_stop(EditorModel *model) {
+    ChangeLog *log = model->changes;
+    if (log == NULL) return;
+    ChangeWatch *w = log->watches;
+    log_drop(log);
+    while (w) {
+        ChangeWatch *next = w->next;
+        watch_free(w);
+        w = next;
+    }
+}
+
+/* The spans of 'w' touching rows row..old_end merged with them into one */
+static void watch_note(ChangeWatch *w, int row, int old_end, int new_end,
+                       unsigned long gen) {
+    if (w->whole) return;
+    ChangeSpan out[CHANGES_MAX_SPANS + 1];
+    const ChangeSpan *s = w->spans;
+    int n = w->nspans, i = 0, count = 0;
+    int delta = new_end - old_end;
+    while (i < n && s[i].last < row - 1) out[count++] = s[i++];
+    int first = row, last = old_end, added = 0;
+    while (i < n && s[i].first <= old_end + 1) {
+        if (s[i].first < first) first = s[i].first;
+        if (s[i].last > last) last = s[i].last;
+        added += s[i].last - s[i].first + 1 - s[i].old_count;
+        i++;
+    }
+    out[count].first = first;
+    out[count].last = last + delta;
+    out[count].old_count = last - first + 1 - added;
+    out[count].gen = gen;
+    count++;
+    for (; i < n; i++, count++) {
+        out[count] = s[i];
+        out[count].first += delta;
+        out[count].last += delta;
+    }
+
+    /* Too many: the two closest become one, with the rows between */
+    if (count > CHANGES_MAX_SPANS) {
+        int best = 0;
+        for (int j = 1; j + 1 < count; j++)
+            if (out[j + 1].first - out[j].last < out[best + 1].first - out[best].last)
+                best = j;
+        int gap = out[best + 1].first - out[best].last - 1;
+        out[best].old_count += gap + out[best + 1].old_count;
+        out[best].last = out[best + 1].last;
+        if (out[best + 1].gen > out[best].gen) out[best].gen = out[best + 1].gen;
+        memmove(&out[best + 1], &out[best + 2],
+                (size_t)(count - best - 2) * sizeof(ChangeSpan));
+        count--;
+    }
+    memcpy(w->spans, out, (size_t)count * sizeof(ChangeSpan));
+    w->nspans = count;
+}
+
+void changes_note_edit(EditorModel *model, int row, int old_end, int new_end) {
+    ChangeLog *log = model->changes;
+    if (log == NULL) return;
+    log->gen++;
+    for (ChangeWatch *w = log->watches; w; w = w->next)
+        watch_note(w, row, old_end, new_end, log->gen);
+}
+
+void changes_note_reset(EditorModel *model) {
+    ChangeLog *log = model->changes;
+    if (log == NULL) return;
+    log->gen++;
+    for (ChangeWatch *w = log->watches; w; w = w->next) {
+        w->whole = 1;
+        w->whole_gen = log->gen;
+        w->nspans = 0;
+    }
+}
+
+unsigned long changes_gen(const EditorModel *model) {
+    return model->changes ? model->changes->gen : 0;
+}
+
+static int pending(const ChangeWatch *w) {
+    return !w->held && (w->whole || w->nspans > 0);
+}
+
+/* Call 'w' with its batch, which it no longer has. The call may stop
+ * any watch, or free the buffer. */
+static int deliver(ChangeLog *log, ChangeWatch *w) {
+    ChangeRecord records[CHANGES_MAX_SPANS];
+    int count = 0;
+    if (w->whole) {
+        records[0].row = 0;
+        records[0].old_count = -1;
+        records[0].new_count = log->model->numrows;
+        records[0].gen = w->whole_gen;
+        count = 1;
+    } else {
+        for (int i = 0; i < w->nspans; i++, count++) {
+            records[count].row = w->spans[i].first;
+            records[count].old_count = w->spans[i].old_count;
+            records[count].new_count = w->spans[i].last - w->spans[i].first + 1;
+            records[count].gen = w->spans[i].gen;
+        }
+    }
+    w->whole = 0;
+    w->nspans = 0;
+    w->due = 0;
+    w->fn(log->model, records, count, w->opaque);
+    return count;
+}
+
+void changes_hold(int id, int hold) {
+    ChangeLog *log;
+    ChangeWatch *w = find_watch(id, &log);
+    if (w == NULL) return;
+    w->held = hold;
+    w->due = 0;
+}
+
+int changes_deliver(int id) {
+    ChangeLog *log;
+    ChangeWatch *w = find_watch(id, &log);
+    if (w == NULL) return -1;
+    if (!w->whole && w->nspans == 0) return 0;
+    return deliver(log, w);
+}
+
+int changes_flush(EditorModel *model) {
+    int delivered = 0;
+    unsigned long tick = ++ticks;
+    /* Looked for again after each call, which may change them */
+    for (;;) {
+        ChangeLog *log = model->changes;
+        ChangeWatch *w = log ? log->watches : NULL;
+        while (w && (!pending(w) || w->ticked == tick)) w = w->next;
+        if (w == NULL) return delivered;
+        w->ticked = tick;
+        delivered += deliver(log, w);
+    }
+}
+
+int changes_tick(uint64_t now) {
+    unsigned long tick = ++ticks;
+    uint64_t next = 0;
+    ChangeLog *log;
+    ChangeWatch *w = NULL;
+    do {
+        /* The first watch due; after a call, looked for again */
+        for (log = logs; log; log = log->next) {
+            for (w = log->watches; w; w = w->next) {
+                if (!pending(w)) continue;
+                if (w->due == 0) w->due = now + (uint64_t)w->interval_ms * 1000000;
+                /* Edits made by the calls of this tick wait for the next */
+                if (now >= w->due && w->ticked != tick) break;
+                if (next == 0 || w->due < next) next = w->due;
+            }
+            if (w) break;
+        }
+        if (w) {
+            w->ticked = tick;
+            deliver(log, w);
+            next = 0;
+        }
+    } while (w);
+    if (next == 0) return -1;
+    return (int)((next - now + 999999) / 1000000);
+}
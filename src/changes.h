@@ -0,0 +1,78 @@
+/* changes.h - Edits of a buffer, batched for plugins
+ *
+ * A watch on a buffer gets the rows its edits changed as a list of
+ * records, not an edit at a time: they are noted (changes_note_edit(),
+ * from the edit paths of core.c that feed the syntax tree and language
+ * servers) as spans of rows, merged as LSP sync merges them, so a burst
+ * of typing on one line is one record of one line. A record says rows
+ * row.. row + old_count - 1 became row.. row + new_count - 1; the records
+ * of a batch are in order down the buffer, each row in the text as it is
+ * after those above it are applied, so they can be applied top down.
+ * When the rows were all replaced (a file opened in the buffer) one
+ * record with old_count -1 covers them.
+ *
+ * changes_tick(), run by the main loop before a frame is drawn, delivers
+ * each watch's batch once its interval has passed since the first edit
+ * in it: at the next frame for an interval of 0. Nothing is noted for a
+ * buffer without a watch. Lua has it as loki.on_change().
+ */
+
+#ifndef LOKI_CHANGES_H
+#define LOKI_CHANGES_H
+
+#include <stdint.h>
+#include "internal.h"
+
+/* Spans a watch keeps apart; beyond, the two closest merge */
+#define CHANGES_MAX_SPANS 32
+
+typedef struct ChangeRecord {
+    int row;                    /* First row, as the text is now */
+    int old_count;              /* Rows it replaced (-1: all of them) */
+    int new_count;              /* Rows it holds now */
+    unsigned long gen;          /* Edit number of its last edit */
+} ChangeRecord;
+
+/* Called with a batch of 'count' records of the buffer of 'model' */
+typedef void (*ChangeFn)(EditorModel *model, const ChangeRecord *records,
+                         int count, void *opaque);
+
+/* Watch the edits of 'model', getting them 'interval_ms' after the first
+ * of a batch. 'release', if not NULL, is called with 'opaque' when the
+ * watch goes. Returns its id, > 0. */
+int changes_watch(EditorModel *model, int interval_ms, ChangeFn fn,
+                  void (*release)(void *opaque), void *opaque);
+
+/* Stop a watch, on whatever buffer. Returns 0, or -1 if there is none. */
+int changes_unwatch(int id);
+
+/* Stop the watches of a buffer going away */
+void changes_stop(EditorModel *model);
+
+/* Rows row..old_end of the buffer became rows row..new_end. */
+void changes_note_edit(EditorModel *model, int row, int old_end, int new_end);
+
+/* The buffer's rows were all replaced */
+void changes_note_reset(EditorModel *model);
+
+/* The edits noted of the buffer, counting from 1 */
+unsigned long changes_gen(const EditorModel *model);
+
+/* Deliver the batches of the buffer's watches now, which must not free
+ * it. Returns the records delivered. */
+int changes_flush(EditorModel *model);
+
+/* Hold the batches of watch 'id' (hold 1), or let them go again (0): a
+ * held watch goes on collecting, but changes_tick() and changes_flush()
+ * pass it by. */
+void changes_hold(int id, int hold);
+
+/* Deliver the batch of watch 'id' now, held or not. Returns the records
+ * delivered, or -1 if there is no such watch. */
+int changes_deliver(int id);
+
+/* Deliver the batches due at 'now_ns', a watch at most once a call.
+ * Returns the ms until the next is due, or -1 if none is waiting. */
+int changes_tick(uint64_t now_ns);
+
+#endif /* LOKI_CHANGES_H */
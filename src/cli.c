@@ -22,6 +22,8 @@ void editor_cli_print_usage(void) {
     printf("  --word-wrap         Enable word wrap\n");
     printf("  --json-rpc          Run in JSON-RPC mode (stdin/stdout)\n");
     printf("  --json-rpc-single   Run single JSON-RPC command and exit\n");
+    printf("  --rpc-format=FMT    RPC messages as json (default) or msgpack\n");
+    printf("  --rpc-server ADDR   Serve RPC on unix:PATH or tcp:HOST:PORT\n");
     printf("  --rows N            Screen rows for headless mode (default: 24)\n");
     printf("  --cols N            Screen cols for headless mode (default: 80)\n");
 #ifdef LOKI_WEB_HOST
@@ -88,6 +90,30 @@ int editor_cli_parse(int argc, char **argv, EditorCliArgs *args) {
             continue;
         }
 
+        /* RPC message format */
+        if (strncmp(arg, "--rpc-format=", 13) == 0) {
+            const char *fmt = arg + 13;
+            if (strcmp(fmt, "msgpack") == 0) {
+                args->rpc_msgpack = 1;
+            } else if (strcmp(fmt, "json") == 0) {
+                args->rpc_msgpack = 0;
+            } else {
+                fprintf(stderr, "Error: --rpc-format must be json or msgpack\n");
+                return -1;
+            }
+            continue;
+        }
+
+        /* RPC server address */
+        if (strcmp(arg, "--rpc-server") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --rpc-server requires an address argument\n");
+                return -1;
+            }
+            args->rpc_server = argv[++i];
+            continue;
+        }
+
         /* Screen rows for headless mode */
         if (strcmp(arg, "--rows") == 0) {
             if (i + 1 >= argc) {
@@ -21,12 +21,14 @@ extern "C" {
 typedef struct {
     const char *filename;       /* File to open (NULL if none) */
     const char *web_root;       /* Web UI directory for web mode (--web-root) */
+    const char *rpc_server;     /* Address to serve RPC on (--rpc-server) */
     int show_help;              /* User requested help (-h, --help) */
     int show_version;           /* User requested version (-v, --version) */
     int line_numbers;           /* Enable line numbers (--line-numbers) */
     int word_wrap;              /* Enable word wrap (--word-wrap) */
     int json_rpc;               /* Run in JSON-RPC mode (--json-rpc) */
     int json_rpc_single;        /* Single-shot JSON-RPC (--json-rpc-single) */
+    int rpc_msgpack;            /* RPC in MessagePack (--rpc-format=msgpack) */
     int web_mode;               /* Run as web server (--web) */
     int web_port;               /* Web server port (--web-port, default 8080) */
     int rows;                   /* Screen rows for headless mode (--rows) */
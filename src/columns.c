@@ -0,0 +1,325 @@
+/* columns.c - Column mode for CSV and TSV files (:columns)
+ *
+ * See columns.h for an overview. The fields are kept in an array by row
+ * number, grown to the last row indexed; a row inserted or deleted above
+ * it moves the entries below, one memmove of a pointer and two ints each.
+ */
+
+#include "columns.h"
+#include "task_pool.h"
+#include "utf8.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fields split into a buffer on the stack first, then the heap */
+#define COLUMNS_SPLIT_INLINE 64
+
+typedef struct ColumnRow {
+    int *starts;            /* count starts, then count widths; NULL: not
+                               indexed */
+    int count;
+    int counted;            /* Its widths are in the columns' counts */
+} ColumnRow;
+
+typedef struct ColumnWidth {
+    int fields[COLUMNS_WIDTH_MAX + 1];  /* Fields of each width, the wider
+                                           at the last */
+    int total;
+    int width;              /* The widest with a count */
+} ColumnWidth;
+
+struct ColumnIndex {
+    char delim;
+    ColumnRow *row;
+    int nrows, cap;
+    ColumnWidth col[COLUMNS_MAX];
+    int indexed;
+    unsigned long gen;
+    ColumnField *layout;    /* Of the last columns_layout() */
+    int layout_cap;
+};
+
+ColumnIndex *columns_new(char delim) {
+    ColumnIndex *ci = calloc(1, sizeof(ColumnIndex));
+    if (ci) ci->delim = delim;
+    return ci;
+}
+
+void columns_clear(ColumnIndex *ci) {
+    if (!ci) return;
+    for (int r = 0; r < ci->nrows; r++) free(ci->row[r].starts);
+    ci->nrows = 0;
+    ci->indexed = 0;
+    memset(ci->col, 0, sizeof(ci->col));
+    ci->gen++;
+}
+
+void columns_free(ColumnIndex *ci) {
+    if (!ci) return;
+    columns_clear(ci);
+    free(ci->row);
+    free(ci->layout);
+    free(ci);
+}
+
+char columns_delim(const ColumnIndex *ci) {
+    return ci->delim;
+}
+
+char columns_delim_for_path(const char *path) {
+    const char *dot = path ? strrchr(path, '.') : NULL;
+    if (!dot) return 0;
+    if (strcmp(dot, ".csv") == 0) return ',';
+    if (strcmp(dot, ".tsv") == 0 || strcmp(dot, ".tab") == 0) return '\t';
+    return 0;
+}
+
+int columns_indexed_rows(const ColumnIndex *ci) {
+    return ci ? ci->indexed : 0;
+}
+
+unsigned long columns_gen(const ColumnIndex *ci) {
+    return ci ? ci->gen : 0;
+}
+
+int columns_width(const ColumnIndex *ci, int col) {
+    return col >= 0 && col < COLUMNS_MAX ? ci->col[col].width : 0;
+}
+
+int columns_count(const ColumnIndex *ci) {
+    int n = COLUMNS_MAX;
+    while (n > 0 && ci->col[n - 1].total == 0) n--;
+    return n;
+}
+
+/* Field starts of the 'size' bytes at 's', as many as fit in 'cap'.
+ * Returns how many there are. */
+static int split(const char *s, int size, char delim, int *starts, int cap) {
+    int n = 1, quoted = 0;
+    if (cap > 0) starts[0] = 0;
+    for (int j = 0; j < size; j++) {
+        if (s[j] == '"' && delim != '\t') {
+            quoted = !quoted;
+        } else if (s[j] == delim && !quoted) {
+            if (n < cap) starts[n] = j + 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* End of field 'i' of an entry (where its delimiter is) */
+static int field_end(const ColumnRow *e, int i, int size) {
+    return i + 1 < e->count ? e->starts[i + 1] - 1 : size;
+}
+
+/* Split a row and measure its fields */
+static void index_row(ColumnRow *e, char delim, const char *chars, int size) {
+    int inline_starts[COLUMNS_SPLIT_INLINE];
+    int n = split(chars, size, delim, inline_starts, COLUMNS_SPLIT_INLINE);
+    e->starts = malloc(sizeof(int) * 2 * (size_t)n);
+    if (e->starts == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    if (n <= COLUMNS_SPLIT_INLINE) memcpy(e->starts, inline_starts, sizeof(int) * (size_t)n);
+    else split(chars, size, delim, e->starts, n);
+    e->count = n;
+    for (int i = 0; i < n; i++)
+        e->starts[n + i] = utf8_width(chars + e->starts[i], field_end(e, i, size) - e->starts[i]);
+}
+
+/* Add the fields of an entry to the columns' counts, or take them away */
+static void count_row(ColumnIndex *ci, ColumnRow *e, int add) {
+    if (e->counted == add) return;
+    e->counted = add;
+    ci->indexed += add ? 1 : -1;
+    for (int i = 0; i < e->count && i < COLUMNS_MAX; i++) {
+        ColumnWidth *c = &ci->col[i];
+        int w = e->starts[e->count + i];
+        if (w > COLUMNS_WIDTH_MAX) w = COLUMNS_WIDTH_MAX;
+        if (add) {
+            c->fields[w]++;
+            c->total++;
+            if (w > c->width) {
+                c->width = w;
+                ci->gen++;
+            }
+        } else {
+            c->fields[w]--;
+            c->total--;
+            if (w == c->width && c->fields[w] == 0) {
+                while (c->width > 0 && c->fields[c->width] == 0) c->width--;
+                ci->gen++;
+            }
+        }
+    }
+}
+
+/* Forget the fields of an entry */
+static void drop(ColumnIndex *ci, ColumnRow *e) {
+    if (e->starts == NULL) return;
+    count_row(ci, e, 0);
+    free(e->starts);
+    e->starts = NULL;
+    e->count = 0;
+}
+
+/* Room for entries of rows 0..nrows-1 */
+static void reserve(ColumnIndex *ci, int nrows) {
+    if (nrows > ci->cap) {
+        int cap = ci->cap ? ci->cap : 1024;
+        while (cap < nrows) cap *= 2;
+        ColumnRow *p = realloc(ci->row, sizeof(ColumnRow) * (size_t)cap);
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        ci->row = p;
+        ci->cap = cap;
+    }
+    if (nrows > ci->nrows) {
+        memset(ci->row + ci->nrows, 0, sizeof(ColumnRow) * (size_t)(nrows - ci->nrows));
+        ci->nrows = nrows;
+    }
+}
+
+/* The entry of 'row', indexed */
+static ColumnRow *entry(ColumnIndex *ci, int row, const char *chars, int size) {
+    reserve(ci, row + 1);
+    ColumnRow *e = &ci->row[row];
+    if (e->starts == NULL) index_row(e, ci->delim, chars, size);
+    count_row(ci, e, 1);
+    return e;
+}
+
+int columns_layout(ColumnIndex *ci, int row, const char *chars, int size,
+                   const ColumnField **fields) {
+    ColumnRow *e = entry(ci, row, chars, size);
+    if (e->count > ci->layout_cap) {
+        int cap = ci->layout_cap ? ci->layout_cap : 16;
+        while (cap < e->count) cap *= 2;
+        ColumnField *p = realloc(ci->layout, sizeof(ColumnField) * (size_t)cap);
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        ci->layout = p;
+        ci->layout_cap = cap;
+    }
+    int col = 0;
+    for (int i = 0; i < e->count; i++) {
+        ColumnField *f = &ci->layout[i];
+        f->start = e->starts[i];
+        f->len = field_end(e, i, size) - f->start;
+        f->width = e->starts[e->count + i];
+        f->col = col;
+        /* Padded out to its column, unless wider; then the delimiter */
+        int w = columns_width(ci, i);
+        col += (w > f->width ? w : f->width) + 1;
+    }
+    *fields = ci->layout;
+    return e->count;
+}
+
+int columns_field_at(const ColumnField *fields, int count, int at) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (fields[mid].start <= at) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int columns_display_col(const ColumnField *fields, int count,
+                        const char *chars, int at) {
+    int i = columns_field_at(fields, count, at);
+    const ColumnField *f = &fields[i];
+    if (at < f->start + f->len) return f->col + utf8_width(chars + f->start, at - f->start);
+    /* The delimiter after the padding, or the end of the row */
+    return i + 1 < count ? fields[i + 1].col - 1 : f->col + f->width;
+}
+
+int columns_field(ColumnIndex *ci, int row, const char *chars, int size,
+                  int field, int *len) {
+    ColumnRow *e = entry(ci, row, chars, size);
+    if (field < 0 || field >= e->count) return -1;
+    *len = field_end(e, field, size) - e->starts[field];
+    return e->starts[field];
+}
+
+typedef struct IndexJob {
+    ColumnIndex *ci;
+    const t_erow *rows;
+    int first, last;
+    int slices;
+    atomic_int next;
+} IndexJob;
+
+static void index_worker(void *arg) {
+    IndexJob *job = arg;
+    int n = job->last - job->first + 1, i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->slices) {
+        int from = job->first + (int)((long long)n * i / job->slices);
+        int to = job->first + (int)((long long)n * (i + 1) / job->slices);
+        for (int r = from; r < to; r++) {
+            ColumnRow *e = &job->ci->row[r];
+            if (e->starts == NULL)
+                index_row(e, job->ci->delim, job->rows[r].chars, job->rows[r].size);
+        }
+    }
+}
+
+void columns_index_rows(ColumnIndex *ci, const t_erow *rows, int first,
+                        int last) {
+    if (!ci || first > last) return;
+    reserve(ci, last + 1);
+
+    /* Split on the pool, the entries apart; counted here after */
+    if (last - first + 1 >= COLUMNS_PARALLEL_MIN) {
+        IndexJob job = { ci, rows, first, last, task_pool_threads(), 0 };
+        if (job.slices > COLUMNS_MAX_WORKERS) job.slices = COLUMNS_MAX_WORKERS;
+        if (job.slices < 1) job.slices = 1;
+        atomic_init(&job.next, 0);
+
+        /* The calling thread works too, so submit one fewer helper. */
+        Task *tasks[COLUMNS_MAX_WORKERS];
+        int started = 0;
+        while (started < job.slices - 1 &&
+               (tasks[started] = task_submit(index_worker, &job, TASK_PRIORITY_HIGH, NULL))) {
+            started++;
+        }
+        index_worker(&job);
+        for (int i = 0; i < started; i++) task_wait(tasks[i]);
+    }
+    for (int r = first; r <= last; r++) entry(ci, r, rows[r].chars, rows[r].size);
+}
+
+void columns_note_insert(ColumnIndex *ci, int at) {
+    if (!ci || at >= ci->nrows) return;
+    int n = ci->nrows;
+    reserve(ci, n + 1);
+    memmove(ci->row + at + 1, ci->row + at, sizeof(ColumnRow) * (size_t)(n - at));
+    memset(&ci->row[at], 0, sizeof(ColumnRow));
+}
+
+void columns_note_delete(ColumnIndex *ci, int at) {
+    columns_note_delete_rows(ci, at, 1);
+}
+
+void columns_note_change(ColumnIndex *ci, int at) {
+    if (!ci || at >= ci->nrows) return;
+    drop(ci, &ci->row[at]);
+}
+
+void columns_note_delete_rows(ColumnIndex *ci, int at, int n) {
+    if (!ci || n <= 0 || at >= ci->nrows) return;
+    if (n > ci->nrows - at) n = ci->nrows - at;
+    for (int r = at; r < at + n; r++) drop(ci, &ci->row[r]);
+    memmove(ci->row + at, ci->row + at + n,
+            sizeof(ColumnRow) * (size_t)(ci->nrows - at - n));
+    ci->nrows -= n;
+}
@@ -0,0 +1,108 @@
+/* columns.h - Column mode for CSV and TSV files (:columns)
+ *
+ * In column mode each row is drawn as its fields, split at a delimiter
+ * (',' outside double quotes, or TAB, ';', '|'), each padded out to the
+ * width of its column and colored by column, so that the columns line up
+ * down the screen. The text itself is not changed.
+ *
+ * Where each row's fields start, and the cells each takes, are found when
+ * the row is first drawn (or a column of it sorted) and cached by row
+ * number; an edit drops the fields of the rows it changed and moves those
+ * of the rows below (columns_note_insert() and friends), as wrap.h does
+ * for breaks. The width of a column is the widest of its fields in the
+ * rows indexed so far, kept as a count of fields at each width up to
+ * COLUMNS_WIDTH_MAX: indexing a row adds its fields, dropping it takes
+ * them away, and a column's width only moves as far as the counts say.
+ * Nothing ever looks at every row to draw a frame, nor to keep the
+ * widths up to date.
+ *
+ * columns_index_rows() indexes a range at once, spread over the task
+ * pool, for operations on whole columns (:sort by a column, and cursors
+ * down a column).
+ */
+
+#ifndef LOKI_COLUMNS_H
+#define LOKI_COLUMNS_H
+
+#include "internal.h"
+
+/* Fields wider are padded to this width at most, and columns past
+ * COLUMNS_MAX are not lined up */
+#define COLUMNS_WIDTH_MAX 48
+#define COLUMNS_MAX 256
+
+/* Rows indexed on one thread below this, and threads used at most */
+#define COLUMNS_PARALLEL_MIN 65536
+#define COLUMNS_MAX_WORKERS 64
+
+typedef struct ColumnIndex ColumnIndex;
+
+/* A field of a row as drawn: chars[start, start+len) (its delimiter not
+ * included), 'width' cells, drawn from display column 'col' */
+typedef struct ColumnField {
+    int start;
+    int len;
+    int width;
+    int col;
+} ColumnField;
+
+/* An empty index of fields split at 'delim'. Returns NULL on out of
+ * memory. */
+ColumnIndex *columns_new(char delim);
+
+/* Release an index. Safe on NULL. */
+void columns_free(ColumnIndex *ci);
+
+/* Forget every row (the buffer was loaded again), keeping the delimiter */
+void columns_clear(ColumnIndex *ci);
+
+char columns_delim(const ColumnIndex *ci);
+
+/* The delimiter a file named 'path' most likely uses, by its extension
+ * (',' for .csv, TAB for .tsv and .tab), or 0 */
+char columns_delim_for_path(const char *path);
+
+/* The fields of row 'row', whose text is chars[0..size), laid out: valid
+ * until the next call. Returns how many (at least 1). */
+int columns_layout(ColumnIndex *ci, int row, const char *chars, int size,
+                   const ColumnField **fields);
+
+/* Display column of chars[at] in a layout of 'count' fields ('at' may be
+ * 'size', past the last field) */
+int columns_display_col(const ColumnField *fields, int count,
+                        const char *chars, int at);
+
+/* The field of a layout chars[at] is in (its delimiter counted in it) */
+int columns_field_at(const ColumnField *fields, int count, int at);
+
+/* Field 'field' of row 'row': its start and length, or -1 if the row has
+ * fewer fields */
+int columns_field(ColumnIndex *ci, int row, const char *chars, int size,
+                  int field, int *len);
+
+/* Index rows first..last of 'rows' (the buffer's), those not indexed yet,
+ * on the task pool for large ranges */
+void columns_index_rows(ColumnIndex *ci, const t_erow *rows, int first,
+                        int last);
+
+/* Width of column 'col' over the rows indexed, and how many columns they
+ * have at most */
+int columns_width(const ColumnIndex *ci, int col);
+int columns_count(const ColumnIndex *ci);
+
+/* Counts every change to the widths: a layout drawn at one count is
+ * drawn the same while it holds */
+unsigned long columns_gen(const ColumnIndex *ci);
+
+/* Row 'at' was inserted, deleted, or had its text changed. */
+void columns_note_insert(ColumnIndex *ci, int at);
+void columns_note_delete(ColumnIndex *ci, int at);
+void columns_note_change(ColumnIndex *ci, int at);
+
+/* Rows at..at+n-1 were deleted. */
+void columns_note_delete_rows(ColumnIndex *ci, int at, int n);
+
+/* Rows whose fields are cached (for tests). */
+int columns_indexed_rows(const ColumnIndex *ci);
+
+#endif /* LOKI_COLUMNS_H */
@@ -7,7 +7,21 @@
  *   - file.c      - :w, :e (file operations)
  *   - basic.c     - :q, :wq, :help, :set, :play, :eval, :stop (core commands)
  *   - goto.c      - :goto, :<number> (navigation)
- *   - substitute.c - :s/old/new/ (search and replace)
+ *   - substitute.c - :s/old/new/, :%s, :N,Ms (search and replace)
+ *   - global.c    - :d, :g/re/cmd, :v/re/cmd (lines of a range, or matching)
+ *   - reindent.c  - :reindent (the indentation of the buffer, or a range)
+ *   - sort.c      - :sort (the lines of the buffer, or a range)
+ *   - columns.c   - :columns (CSV/TSV fields lined up, cursors down one)
+ *   - fold.c      - :fold, :foldopen, :foldindent, ... (code folding)
+ *   - preview.c   - :preview (the buffer as Markdown, in a browser)
+ *   - grep.c      - :grep, :bsearch (search files, or the open buffers)
+ *   - diff.c      - :diff (a buffer against another, or its saved file)
+ *   - filter.c    - :[range]!cmd (lines through an external command)
+ *   - lsp.c       - :lsp (a language server for the buffer)
+ *   - session.c   - :mksession, :session (the open buffers, saved and restored)
+ *   - tag.c       - :tag, :tag! (definitions in the project's symbol index)
+ *   - find.c      - :find, :find! (project files, by fuzzy match)
+ *   - undo.c      - :undo, :redo, :earlier, :later (the undo tree)
  *
  * To add a new command:
  *   1. Create a new file in command/ (or add to existing category)
@@ -21,16 +35,33 @@
 #include "command.h"
 #include "internal.h"
 #include "command/command_impl.h"
+#include "regexp.h"
+#include "search.h"
+#include "terminal.h"
+#include "marks.h"
+#include "history.h"
 #include <lua.h>
 
-/* Command history storage */
-static char *command_history[COMMAND_HISTORY_MAX];
-static int command_history_count = 0;
+/* Command history, opened when first used */
+static HistoryLog *command_log = NULL;
 
-/* Dynamic command registry (for Lua-registered commands) */
-#define MAX_DYNAMIC_COMMANDS 100
-static command_def_t dynamic_commands[MAX_DYNAMIC_COMMANDS];
+/* Dynamic command registry (for Lua-registered commands), each allocated
+ * on its own so that the pointers handed out stay valid as it grows */
+static command_def_t **dynamic_commands = NULL;
 static int dynamic_command_count = 0;
+static int dynamic_command_cap = 0;
+
+/* Every command, builtin and dynamic, indexed by name: an open-addressing
+ * hash table for exact lookup, and the same commands sorted by name, where
+ * those starting with a prefix are a run found by binary search (for
+ * abbreviations and Tab completion). Built on first use, kept up to date
+ * by command_register(), and dropped by command_unregister_all_dynamic(). */
+static command_def_t **command_table = NULL;   /* command_table_size slots */
+static size_t command_table_size = 0;
+static command_def_t **command_sorted = NULL;  /* command_index_count */
+static int command_index_count = 0;
+static int command_sorted_cap = 0;
+static int command_index_valid = 0;
 
 /* Built-in command table
  * Format: {name, handler, help_text, min_args, max_args}
@@ -41,6 +72,10 @@ static command_def_t builtin_commands[] = {
     {"write",  cmd_write,       "Write (save) file",              0, 1},
     {"e",      cmd_edit,        "Edit file",                      1, 1},
     {"edit",   cmd_edit,        "Edit file",                      1, 1},
+    {"view",   cmd_view,        "Show a file read-only, a window at a time: view [file]", 0, 1},
+    {"split",  cmd_split,       "Show this buffer in a new tab too", 0, 0},
+    {"follow", cmd_follow,      "Follow the file as it grows: follow [rows|off]", 0, 1},
+    {"reload", cmd_reload,      "Load the file's changes on disk (undoable)", 0, 0},
 
     /* Basic commands (basic.c) */
     {"q",      cmd_quit,        "Quit editor",                    0, 0},
@@ -56,6 +91,74 @@ static command_def_t builtin_commands[] = {
     /* Navigation (goto.c) */
     {"goto",   cmd_goto,        "Go to line number",              1, 1},
 
+    /* Lines of a range, or matching a pattern (global.c) */
+    {"d",      cmd_delete,      "Delete lines: [range]d [count]", 0, 1},
+    {"delete", cmd_delete,      "Delete lines: [range]d [count]", 0, 1},
+    {"g",      cmd_global,      "Run d or s on matching lines: [range]g/re/cmd", 1, -1},
+    {"global", cmd_global,      "Run d or s on matching lines: [range]g/re/cmd", 1, -1},
+    {"v",      cmd_vglobal,     "Run d or s on other lines: [range]v/re/cmd", 1, -1},
+    {"vglobal", cmd_vglobal,    "Run d or s on other lines: [range]v/re/cmd", 1, -1},
+
+    /* Indentation (reindent.c) */
+    {"reindent", cmd_reindent,  "Reindent the buffer, or a range", 0, 0},
+
+    /* Sorting (sort.c) */
+    {"sort",   cmd_sort,        "Sort lines: [range]sort [n][r][u] [column]", 0, -1},
+
+    /* Column mode (columns.c) */
+    {"columns", cmd_columns,    "Line up CSV/TSV fields: columns [,|;|||tab|off|select N]", 0, -1},
+
+    /* Folding (fold.c) */
+    {"fold",   cmd_fold,        "Fold a range of lines: [range]fold", 0, 0},
+    {"foldopen", cmd_foldopen,  "Open the fold at the cursor",    0, 0},
+    {"foldclose", cmd_foldclose, "Close the fold at the cursor",  0, 0},
+    {"foldindent", cmd_foldindent, "Fold by indentation",         0, 0},
+    {"foldsyntax", cmd_foldsyntax, "Fold by the syntax tree",     0, 0},
+    {"foldclear", cmd_foldclear, "Remove every fold",             0, 0},
+
+    /* Markdown preview (preview.c) */
+    {"preview", cmd_preview,    "Preview as Markdown in a browser: preview [port|stop]", 0, 1},
+
+    /* Undo tree (undo.c) */
+    {"undo",   cmd_undo,        "Undo, or go to undo state N",    0, 1},
+    {"redo",   cmd_redo,        "Redo",                           0, 0},
+    {"earlier", cmd_earlier,    "Go back N undo states, or Ns/m/h/d", 0, 1},
+    {"later",  cmd_later,       "Go forward N undo states, or Ns/m/h/d", 0, 1},
+
+    /* Crash recovery (recover.c) */
+    {"recover", cmd_recover,    "Restore unsaved changes left by a crash", 0, 0},
+    {"recover!", cmd_recover_discard, "Delete unsaved changes left by a crash", 0, 0},
+
+    /* Sessions (session.c) */
+    {"mksession", cmd_mksession, "Write the open buffers to a session: mksession [file]", 0, 1},
+    {"session", cmd_session,    "Open the buffers of a session: session [file]", 0, 1},
+
+    /* Project and buffer search (grep.c) */
+    {"grep",   cmd_grep,        "Search files under a directory", 1, -1},
+    {"bsearch", cmd_bsearch,    "Search every open buffer",       1, -1},
+    {"bsnext", cmd_bsnext,      "Next :bsearch match",            0, 0},
+    {"bsprev", cmd_bsprev,      "Previous :bsearch match",        0, 0},
+
+    /* Diffs (diff.c) */
+    {"diff",   cmd_diff,        "Diff against buffer N or the saved file: diff [N|next|prev|off]", 0, 1},
+
+    /* Language servers (lsp.c) */
+    {"lsp",    cmd_lsp,         "Language server for the buffer: lsp [cmd|off|hover]", 0, -1},
+
+    /* Symbol index (tag.c) */
+    {"tag",    cmd_tag,         "Go to a definition in the project: tag [name]", 0, 1},
+    {"tag!",   cmd_tag_refresh, "Index the files changed outside the editor", 0, 0},
+
+    /* File finder (find.c) */
+    {"find",   cmd_find,         "Open the project file best matching: find [query]", 0, 1},
+    {"find!",  cmd_find_refresh, "List the project's files again", 0, 0},
+
+    /* Runtime statistics (stats.c) */
+    {"stats",  cmd_stats,       "Show async, Lua GC or memory stats", 1, 2},
+
+    /* Lua profiling (profile.c) */
+    {"profile", cmd_profile,    "Profile Lua: start, stop, reset, dump", 1, 3},
+
     /* Language evaluation (basic.c) */
     {"play",   cmd_play,        "Play entire buffer",             0, 0},
     {"eval",   cmd_eval,        "Evaluate code or current line",  0, -1},
@@ -67,6 +170,22 @@ static command_def_t builtin_commands[] = {
     {NULL, NULL, NULL, 0, 0}  /* Sentinel */
 };
 
+/* Commands that take a line range, as :10,20d, and their range forms */
+typedef int (*range_handler_t)(editor_ctx_t *ctx, int first, int last, const char *args);
+
+static const struct {
+    command_handler_t handler;
+    range_handler_t range;
+} range_commands[] = {
+    {cmd_delete,  cmd_delete_range},
+    {cmd_global,  cmd_global_range},
+    {cmd_vglobal, cmd_vglobal_range},
+    {cmd_reindent, cmd_reindent_range},
+    {cmd_sort,    cmd_sort_range},
+    {cmd_columns, cmd_columns_range},
+    {cmd_fold,    cmd_fold_range},
+};
+
 /* ======================== Command State Management ======================== */
 
 void command_mode_init(editor_ctx_t *ctx) {
@@ -88,7 +207,7 @@ void command_mode_enter(editor_ctx_t *ctx) {
     ctx->view.cmd_buffer[1] = '\0';
     ctx->view.cmd_length = 1;
     ctx->view.cmd_cursor_pos = 1;
-    ctx->view.cmd_history_index = command_history_count;  /* Start at end of history */
+    ctx->view.cmd_history_index = command_history_len();  /* Start at end of history */
     editor_set_status_msg(ctx, ":");
 }
 
@@ -102,61 +221,225 @@ void command_mode_exit(editor_ctx_t *ctx) {
 
 /* ======================== Command History ======================== */
 
+/* The history log, with what other processes added since last asked */
+static HistoryLog *command_history_log(void) {
+    if (!command_log) {
+        command_log = history_open("cmd");
+        if (!command_log) {
+            perror("Out of memory");
+            exit(1);
+        }
+    } else {
+        history_refresh(command_log);
+    }
+    return command_log;
+}
+
 static void command_history_add(const char *cmd) {
-    /* Don't add empty or duplicate commands */
+    /* Empty commands and repeats of the last are not added */
     if (!cmd || !cmd[0]) return;
-    if (command_history_count > 0 &&
-        strcmp(command_history[command_history_count - 1], cmd) == 0) {
-        return;
-    }
+    history_add(command_history_log(), cmd);
+}
 
-    /* Add to history */
-    if (command_history_count < COMMAND_HISTORY_MAX) {
-        command_history[command_history_count++] = strdup(cmd);
-    } else {
-        /* Shift and reuse oldest slot */
-        free(command_history[0]);
-        memmove(command_history, command_history + 1,
-                sizeof(char*) * (COMMAND_HISTORY_MAX - 1));
-        command_history[COMMAND_HISTORY_MAX - 1] = strdup(cmd);
-    }
+/* Entry 'index' (0 the newest) of the 'count' in 'log', or NULL */
+static const char *history_at(HistoryLog *log, int count, int index) {
+    if (index < 0 || index >= count) return NULL;
+    return history_get(log, count - 1 - index);
 }
 
 const char* command_history_get(int index) {
-    if (index < 0 || index >= command_history_count) return NULL;
-    return command_history[index];
+    HistoryLog *log = command_history_log();
+    return history_at(log, history_count(log), index);
 }
 
 int command_history_len(void) {
-    return command_history_count;
+    return history_count(command_history_log());
 }
 
 void command_history_free(void) {
-    for (int i = 0; i < command_history_count; i++) {
-        free(command_history[i]);
-        command_history[i] = NULL;
+    history_close(command_log);
+    command_log = NULL;
+}
+
+/* Show history entry 'hist' as the command line */
+static void command_line_set(editor_ctx_t *ctx, const char *hist) {
+    ctx->view.cmd_buffer[0] = ':';
+    strncpy(ctx->view.cmd_buffer + 1, hist, sizeof(ctx->view.cmd_buffer) - 2);
+    ctx->view.cmd_buffer[sizeof(ctx->view.cmd_buffer) - 1] = '\0';
+    ctx->view.cmd_length = strlen(ctx->view.cmd_buffer);
+    ctx->view.cmd_cursor_pos = ctx->view.cmd_length;
+    editor_set_status_msg(ctx, "%s", ctx->view.cmd_buffer);
+}
+
+/* Ctrl-R: the next older command starting with what was typed before the
+ * first Ctrl-R, skipping those already shown */
+static void command_history_search(editor_ctx_t *ctx) {
+    /* Refreshed once: the count and the entries from the same read */
+    HistoryLog *log = command_history_log();
+    int count = history_count(log);
+    const char *shown = history_at(log, count, ctx->view.cmd_history_index);
+    int from = count - ctx->view.cmd_history_index;
+    if (!shown || strcmp(shown, ctx->view.cmd_buffer + 1) != 0) {
+        /* Edited since: a new search, on what is there */
+        ctx->view.cmd_search_len = ctx->view.cmd_length - 1;
+        from = 0;
     }
-    command_history_count = 0;
+    int age = history_find(log, ctx->view.cmd_buffer + 1,
+                           (size_t)ctx->view.cmd_search_len, from);
+    if (age < 0) {
+        editor_set_status_msg(ctx, "%s  [no older match]", ctx->view.cmd_buffer);
+        return;
+    }
+    ctx->view.cmd_history_index = count - 1 - age;
+    command_line_set(ctx, history_get(log, age));
 }
 
 /* ======================== Command Lookup ======================== */
 
-/* Find command definition (builtin or dynamic) */
+static uint32_t command_hash(const char *name) {
+    uint32_t h = 2166136261u;               /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static void *command_alloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+static int builtin_command_count(void) {
+    static int count = -1;
+    if (count < 0)
+        for (count = 0; builtin_commands[count].name != NULL; count++) ;
+    return count;
+}
+
+static int is_builtin(const command_def_t *cmd) {
+    return cmd >= builtin_commands && cmd < builtin_commands + builtin_command_count();
+}
+
+/* Index of the first sorted command whose name is not before 'name' */
+static int sorted_lower_bound(const char *name) {
+    int lo = 0, hi = command_index_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(command_sorted[mid]->name, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void table_put(command_def_t *cmd) {
+    size_t mask = command_table_size - 1;
+    size_t i = command_hash(cmd->name) & mask;
+    while (command_table[i]) i = (i + 1) & mask;
+    command_table[i] = cmd;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp((*(command_def_t *const *)a)->name, (*(command_def_t *const *)b)->name);
+}
+
+/* Index every command from scratch, with room for as many again */
+static void command_index_build(void) {
+    int count = builtin_command_count() + dynamic_command_count;
+    size_t size = 64;
+    while (size < (size_t)count * 4) size *= 2;     /* At most half full */
+    free(command_table);
+    command_table = command_alloc(NULL, sizeof(*command_table) * size);
+    memset(command_table, 0, sizeof(*command_table) * size);
+    command_table_size = size;
+
+    if (command_sorted_cap < count) {
+        command_sorted_cap = count * 2;
+        command_sorted = command_alloc(command_sorted,
+                                       sizeof(*command_sorted) * (size_t)command_sorted_cap);
+    }
+    command_index_count = 0;
+    for (int i = 0; i < builtin_command_count(); i++)
+        command_sorted[command_index_count++] = &builtin_commands[i];
+    for (int i = 0; i < dynamic_command_count; i++)
+        command_sorted[command_index_count++] = dynamic_commands[i];
+    for (int i = 0; i < command_index_count; i++) table_put(command_sorted[i]);
+    qsort(command_sorted, (size_t)command_index_count, sizeof(*command_sorted), compare_names);
+    command_index_valid = 1;
+}
+
+/* Index a command just registered */
+static void command_index_add(command_def_t *cmd) {
+    if (!command_index_valid || (size_t)(command_index_count + 1) * 2 > command_table_size ||
+        command_index_count == command_sorted_cap) {
+        command_index_build();
+        return;
+    }
+    table_put(cmd);
+    int at = sorted_lower_bound(cmd->name);
+    memmove(command_sorted + at + 1, command_sorted + at,
+            sizeof(*command_sorted) * (size_t)(command_index_count - at));
+    command_sorted[at] = cmd;
+    command_index_count++;
+}
+
+/* Find command definition (builtin or dynamic) by its exact name */
 static command_def_t* find_command(const char *name) {
-    /* Check built-in commands */
-    for (int i = 0; builtin_commands[i].name != NULL; i++) {
-        if (strcmp(builtin_commands[i].name, name) == 0) {
-            return &builtin_commands[i];
+    if (!command_index_valid) command_index_build();
+    size_t mask = command_table_size - 1;
+    for (size_t i = command_hash(name) & mask; command_table[i]; i = (i + 1) & mask) {
+        if (strcmp(command_table[i]->name, name) == 0) {
+            return command_table[i];
         }
     }
+    return NULL;
+}
 
-    /* Check dynamic (Lua-registered) commands */
-    for (int i = 0; i < dynamic_command_count; i++) {
-        if (strcmp(dynamic_commands[i].name, name) == 0) {
-            return &dynamic_commands[i];
-        }
+/* The run [*first, *last) of sorted commands whose names start with
+ * 'prefix' */
+static void prefix_range(const char *prefix, int *first, int *last) {
+    if (!command_index_valid) command_index_build();
+    size_t len = strlen(prefix);
+    int lo = sorted_lower_bound(prefix), hi = command_index_count;
+    *first = lo;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strncmp(command_sorted[mid]->name, prefix, len) == 0) lo = mid + 1;
+        else hi = mid;
     }
+    *last = lo;
+}
 
+/* The command 'name' stands for: its own, or the one it abbreviates, as
+ * :wri for :write. Bang variants (:q!) are never abbreviated, and a
+ * builtin wins over Lua-registered commands of the same prefix, so that
+ * plugins do not break abbreviations already typed by habit. Returns NULL
+ * if there is none, or (with *ambiguous set) several. */
+static command_def_t *resolve_command(const char *name, int *ambiguous) {
+    *ambiguous = 0;
+    command_def_t *cmd = find_command(name);
+    if (cmd) return cmd;
+
+    int first, last;
+    prefix_range(name, &first, &last);
+    command_def_t *builtin = NULL, *dynamic = NULL;
+    int builtins = 0, dynamics = 0;
+    for (int i = first; i < last; i++) {
+        command_def_t *c = command_sorted[i];
+        if (strchr(c->name, '!')) continue;
+        if (is_builtin(c)) {
+            builtin = c;
+            builtins++;
+        } else {
+            dynamic = c;
+            dynamics++;
+        }
+    }
+    if (builtins == 1) return builtin;
+    if (builtins == 0 && dynamics == 1) return dynamic;
+    *ambiguous = builtins + dynamics > 1;
     return NULL;
 }
 
@@ -165,6 +448,13 @@ command_def_t* command_find(const char *name) {
     return find_command(name);
 }
 
+int command_complete(const char *prefix, const command_def_t **out, int max) {
+    int first, last;
+    prefix_range(prefix ? prefix : "", &first, &last);
+    for (int i = first; i < last && i - first < max; i++) out[i - first] = command_sorted[i];
+    return last - first;
+}
+
 /* ======================== Command Parsing ======================== */
 
 /* Parse command line into command name and arguments */
@@ -204,16 +494,6 @@ static int parse_command(const char *cmdline, char **cmd_name, char **args) {
     return 1;
 }
 
-/* Helper: check if string is all digits */
-static int is_all_digits(const char *s) {
-    if (!s || !*s) return 0;
-    while (*s) {
-        if (!isdigit((unsigned char)*s)) return 0;
-        s++;
-    }
-    return 1;
-}
-
 /* Helper: check if command is a substitute pattern */
 static int is_substitute_pattern(const char *cmd) {
     /* Match s/.../.../[g] pattern */
@@ -222,13 +502,144 @@ static int is_substitute_pattern(const char *cmd) {
     return 1;
 }
 
+/* Helper: check if command is a global one, :g/re/cmd, :g!/re/cmd or
+ * :v/re/cmd (in full or not). Returns where its /re/ starts, setting
+ * *invert for :g! and :v, or NULL. */
+static const char *global_pattern(const char *cmd, int *invert) {
+    static const char *names[] = { "global", "g", "vglobal", "v" };
+    for (int i = 0; i < 4; i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(cmd, names[i], len) != 0) continue;
+        const char *p = cmd + len;
+        *invert = names[i][0] == 'v';
+        if (*p == '!' && !*invert) {
+            *invert = 1;
+            p++;
+        }
+        if (*p == '/') return p;
+    }
+    return NULL;
+}
+
+/* The form of 'cmd' that takes a line range, or NULL */
+static range_handler_t range_form(const command_def_t *cmd) {
+    for (size_t i = 0; i < sizeof(range_commands) / sizeof(range_commands[0]); i++)
+        if (range_commands[i].handler == cmd->handler) return range_commands[i].range;
+    return NULL;
+}
+
+/* Helper: the row of the next line matching the pattern at *p, /re/
+ * searching forward from the cursor or ?re? backward, wrapping around.
+ * Returns 1, or -1 (status set). */
+static int parse_search_address(editor_ctx_t *ctx, const char **p, int *row) {
+    char delim = **p;
+    struct abuf pattern = ABUF_INIT;
+    const char *s = command_parse_delimited(*p + 1, delim, &pattern);
+    if (*s == delim) s++;
+    terminal_buffer_append(&pattern, "", 1);
+    *p = s;
+
+    if (pattern.b[0] == '\0') {
+        editor_set_status_msg(ctx, "Empty search pattern");
+        terminal_buffer_free(&pattern);
+        return -1;
+    }
+    const char *error;
+    int icase = search_ignores_case(ctx, pattern.b, pattern.len - 1, 1);
+    Regexp *re = regexp_compile(pattern.b, icase ? REGEXP_ICASE : 0, &error);
+    if (!re) {
+        editor_set_status_msg(ctx, "Invalid pattern: %s", error);
+        terminal_buffer_free(&pattern);
+        return -1;
+    }
+
+    int numrows = ctx->model.numrows, found = -1;
+    int step = delim == '/' ? 1 : -1;
+    int at = ctx->view.rowoff + ctx->view.cy;
+    for (int i = 1; i <= numrows && found < 0; i++) {
+        int r = ((at + step * i) % numrows + numrows) % numrows;
+        const t_erow *er = &ctx->model.row[r];
+        int start, end;
+        if (regexp_search(re, er->chars, er->size, 0, &start, &end)) found = r;
+    }
+    if (found < 0) editor_set_status_msg(ctx, "Pattern not found: %s", pattern.b);
+    regexp_free(re);
+    terminal_buffer_free(&pattern);
+    if (found < 0) return -1;
+    *row = found;
+    return 1;
+}
+
+/* Helper: parse one line address at *p into a row: N, '.', '$', '< / '>
+ * (the last visual selection), or /re/ / ?re? (the next line matching
+ * 're' after or before the cursor), then any +N / -N. Returns 1 if there
+ * was one, 0 if not, -1 (status set) if it is invalid. */
+static int parse_address(editor_ctx_t *ctx, const char **p, int *row) {
+    const char *s = *p;
+    if (isdigit((unsigned char)*s)) {
+        *row = (int)strtol(s, (char **)&s, 10) - 1;
+    } else if (*s == '.') {
+        *row = ctx->view.rowoff + ctx->view.cy;
+        s++;
+    } else if (*s == '$') {
+        *row = ctx->model.numrows - 1;
+        s++;
+    } else if (*s == '\'' && (s[1] == '<' || s[1] == '>')) {
+        int col;
+        if (!ctx->view.vmark_set ||
+            marks_get(ctx->model.marks, s[1] == '<' ? ctx->view.vmark_start
+                                                    : ctx->view.vmark_end,
+                      row, &col) != 0) {
+            editor_set_status_msg(ctx, "Mark not set");
+            return -1;
+        }
+        s += 2;
+    } else if (*s == '/' || *s == '?') {
+        if (parse_search_address(ctx, &s, row) < 0) return -1;
+    } else {
+        return 0;
+    }
+    while (*s == '+' || *s == '-') {
+        int sign = *s++ == '+' ? 1 : -1;
+        int n = isdigit((unsigned char)*s) ? (int)strtol(s, (char **)&s, 10) : 1;
+        *row += sign * n;
+    }
+    *p = s;
+    return 1;
+}
+
+/* Helper: parse a line range at *p: '%' (every line), or one address or
+ * two separated by ','. Returns 1 if there was one, 0 if not, -1 (status
+ * set) if it is invalid. */
+static int parse_range(editor_ctx_t *ctx, const char **p, int *first, int *last) {
+    if (**p == '%') {
+        (*p)++;
+        *first = 0;
+        *last = ctx->model.numrows - 1;
+        return 1;
+    }
+    int found = parse_address(ctx, p, first);
+    if (found <= 0) return found;
+    *last = *first;
+    if (**p == ',') {
+        (*p)++;
+        found = parse_address(ctx, p, last);
+        if (found == 0) editor_set_status_msg(ctx, "Invalid range");
+        if (found <= 0) return -1;
+    }
+    if (*first > *last) {
+        editor_set_status_msg(ctx, "Backwards range");
+        return -1;
+    }
+    return 1;
+}
+
 /* ======================== Command Execution ======================== */
 
 int command_execute(editor_ctx_t *ctx, const char *cmdline) {
-    char *cmd_name = NULL;
-    char *args = NULL;
-
-    if (!parse_command(cmdline, &cmd_name, &args)) {
+    const char *p = cmdline;
+    while (*p == ':' || isspace((unsigned char)*p)) p++;
+    if (!*p) {
         editor_set_status_msg(ctx, "");
         return 0;
     }
@@ -236,33 +647,72 @@ int command_execute(editor_ctx_t *ctx, const char *cmdline) {
     /* Add to history */
     command_history_add(cmdline + 1);  /* Skip ':' prefix */
 
-    /* Special case: numeric command like :123 -> go to line 123 */
-    if (is_all_digits(cmd_name)) {
-        int result = cmd_goto(ctx, cmd_name);
-        free(cmd_name);
-        free(args);
-        return result;
+    /* Special case: :N% goes that far into the file. In a large file
+     * loaded a window at a time, :$ is its last line, not the window's */
+    size_t digits = strspn(p, "0123456789");
+    if (digits > 0 && p[digits] == '%' && p[digits + 1] == '\0')
+        return cmd_goto(ctx, p);
+    if (ctx->model.lazy && strcmp(p, "$") == 0)
+        return cmd_goto(ctx, "100%");
+
+    /* A leading line range, as in :%s, :10,20d, :'<,'>s or :/re/,$d */
+    int first = 0, last = 0;
+    int range = parse_range(ctx, &p, &first, &last);
+    if (range < 0) return 0;
+    while (isspace((unsigned char)*p)) p++;
+
+    /* Special case: a range alone, like :123 or :$ -> go to its last line */
+    if (range && !*p) {
+        char line[16];
+        snprintf(line, sizeof(line), "%d", last + 1);
+        return cmd_goto(ctx, line);
     }
 
-    /* Special case: substitute pattern like :s/old/new/[g] */
-    if (is_substitute_pattern(cmd_name)) {
-        /* Reconstruct the full pattern (cmd_name + args) */
-        char pattern[512];
-        if (args && args[0]) {
-            snprintf(pattern, sizeof(pattern), "%s %s", cmd_name, args);
-        } else {
-            snprintf(pattern, sizeof(pattern), "%s", cmd_name);
+    /* Special case: substitute pattern like :s/old/new/[g]. The pattern
+     * is taken as typed, spaces included. */
+    if (is_substitute_pattern(p)) {
+        return range ? cmd_substitute_range(ctx, first, last, p)
+                     : cmd_substitute(ctx, p);
+    }
+
+    /* Special case: :[range]!cmd filters the lines through a command,
+     * taken as typed; :! alone stops the filter */
+    if (*p == '!') {
+        return range ? cmd_filter_range(ctx, first, last, p + 1)
+                     : cmd_filter(ctx, p + 1);
+    }
+
+    /* Special case: :g/re/cmd and :v/re/cmd, over the whole buffer
+     * without a range */
+    int invert;
+    const char *global = global_pattern(p, &invert);
+    if (global) {
+        if (!range) {
+            first = 0;
+            last = ctx->model.numrows - 1;
         }
-        int result = cmd_substitute(ctx, pattern);
-        free(cmd_name);
-        free(args);
-        return result;
+        return invert ? cmd_vglobal_range(ctx, first, last, global)
+                      : cmd_global_range(ctx, first, last, global);
     }
 
+    char *cmd_name = NULL;
+    char *args = NULL;
+    if (!parse_command(p, &cmd_name, &args)) return 0;
+
     /* Find command handler */
-    command_def_t *cmd = find_command(cmd_name);
+    int ambiguous;
+    command_def_t *cmd = resolve_command(cmd_name, &ambiguous);
     if (!cmd) {
-        editor_set_status_msg(ctx, "Unknown command: %s", cmd_name);
+        editor_set_status_msg(ctx, "%s command: %s", ambiguous ? "Ambiguous" : "Unknown",
+                              cmd_name);
+        free(cmd_name);
+        free(args);
+        return 0;
+    }
+
+    range_handler_t by_range = range ? range_form(cmd) : NULL;
+    if (range && !by_range) {
+        editor_set_status_msg(ctx, "No range allowed");
         free(cmd_name);
         free(args);
         return 0;
@@ -277,15 +727,16 @@ int command_execute(editor_ctx_t *ctx, const char *cmdline) {
         return 0;
     }
 
-    /* Store command name for Lua handlers (they need to know which command was called) */
+    /* Store command name for Lua handlers (they need to know which command
+     * was called), in full if it was abbreviated */
     if (ctx_L(ctx)) {
         lua_State *L = ctx_L(ctx);
-        lua_pushstring(L, cmd_name);
+        lua_pushstring(L, cmd->name);
         lua_setglobal(L, "_loki_ex_command_executing");
     }
 
     /* Execute command */
-    int result = cmd->handler(ctx, args);
+    int result = by_range ? by_range(ctx, first, last, args) : cmd->handler(ctx, args);
 
     /* Clear the command name */
     if (ctx_L(ctx)) {
@@ -301,6 +752,28 @@ int command_execute(editor_ctx_t *ctx, const char *cmdline) {
 
 /* ======================== Command Mode Input Handling ======================== */
 
+/* Tab: complete the command name typed at the end of the line, as far as
+ * the commands starting with it agree (in full if there is one) */
+static void complete_command_name(editor_ctx_t *ctx) {
+    char *name = ctx->view.cmd_buffer + 1;
+    if (ctx->view.cmd_cursor_pos != ctx->view.cmd_length || !*name ||
+        strpbrk(name, " \t")) return;
+
+    int first, last;
+    prefix_range(name, &first, &last);
+    if (first == last) return;
+
+    /* The sorted run's first and last names share what they all share */
+    const char *a = command_sorted[first]->name, *b = command_sorted[last - 1]->name;
+    size_t len = 0;
+    while (a[len] && a[len] == b[len]) len++;
+    if (len >= (size_t)COMMAND_BUFFER_SIZE - 1) len = COMMAND_BUFFER_SIZE - 2;
+    memcpy(name, a, len);
+    name[len] = '\0';
+    ctx->view.cmd_length = ctx->view.cmd_cursor_pos = (int)len + 1;
+    editor_set_status_msg(ctx, "%s", ctx->view.cmd_buffer);
+}
+
 void command_mode_handle_key(editor_ctx_t *ctx, int fd, int key) {
     (void)fd;  /* fd parameter for future use */
 
@@ -351,43 +824,35 @@ void command_mode_handle_key(editor_ctx_t *ctx, int fd, int key) {
             if (ctx->view.cmd_history_index > 0) {
                 ctx->view.cmd_history_index--;
                 const char *hist = command_history_get(ctx->view.cmd_history_index);
-                if (hist) {
-                    ctx->view.cmd_buffer[0] = ':';
-                    strncpy(ctx->view.cmd_buffer + 1, hist,
-                            sizeof(ctx->view.cmd_buffer) - 2);
-                    ctx->view.cmd_buffer[sizeof(ctx->view.cmd_buffer) - 1] = '\0';
-                    ctx->view.cmd_length = strlen(ctx->view.cmd_buffer);
-                    ctx->view.cmd_cursor_pos = ctx->view.cmd_length;
-                    editor_set_status_msg(ctx, "%s", ctx->view.cmd_buffer);
-                }
+                if (hist) command_line_set(ctx, hist);
             }
             break;
 
         case ARROW_DOWN:
             /* Next command in history */
-            if (ctx->view.cmd_history_index < command_history_count - 1) {
+            if (ctx->view.cmd_history_index < command_history_len() - 1) {
                 ctx->view.cmd_history_index++;
                 const char *hist = command_history_get(ctx->view.cmd_history_index);
-                if (hist) {
-                    ctx->view.cmd_buffer[0] = ':';
-                    strncpy(ctx->view.cmd_buffer + 1, hist,
-                            sizeof(ctx->view.cmd_buffer) - 2);
-                    ctx->view.cmd_buffer[sizeof(ctx->view.cmd_buffer) - 1] = '\0';
-                    ctx->view.cmd_length = strlen(ctx->view.cmd_buffer);
-                    ctx->view.cmd_cursor_pos = ctx->view.cmd_length;
-                    editor_set_status_msg(ctx, "%s", ctx->view.cmd_buffer);
-                }
+                if (hist) command_line_set(ctx, hist);
             } else {
                 /* At end of history, clear command */
                 ctx->view.cmd_buffer[0] = ':';
                 ctx->view.cmd_buffer[1] = '\0';
                 ctx->view.cmd_length = 1;
                 ctx->view.cmd_cursor_pos = 1;
-                ctx->view.cmd_history_index = command_history_count;
+                ctx->view.cmd_history_index = command_history_len();
                 editor_set_status_msg(ctx, ":");
             }
             break;
 
+        case CTRL_R:
+            command_history_search(ctx);
+            break;
+
+        case TAB:
+            if (!find_complete(ctx)) complete_command_name(ctx);
+            break;
+
         case CTRL_U:
             /* Clear command line */
             ctx->view.cmd_buffer[0] = ':';
@@ -411,36 +876,58 @@ void command_mode_handle_key(editor_ctx_t *ctx, int fd, int key) {
             }
             break;
     }
+
+    /* The files a :find being typed would open */
+    if (ctx->view.mode == MODE_COMMAND) find_preview(ctx);
 }
 
 /* ======================== Dynamic Command Registration (for Lua) ======================== */
 
 int command_register(const char *name, command_handler_t handler,
                      const char *help, int min_args, int max_args) {
-    if (dynamic_command_count >= MAX_DYNAMIC_COMMANDS) {
-        return 0;  /* Registry full */
-    }
-
     /* Check if command already exists */
     if (find_command(name)) {
         return 0;  /* Can't override built-in or existing command */
     }
 
     /* Register new command */
-    dynamic_commands[dynamic_command_count].name = strdup(name);
-    dynamic_commands[dynamic_command_count].handler = handler;
-    dynamic_commands[dynamic_command_count].help = strdup(help);
-    dynamic_commands[dynamic_command_count].min_args = min_args;
-    dynamic_commands[dynamic_command_count].max_args = max_args;
-    dynamic_command_count++;
+    if (dynamic_command_count == dynamic_command_cap) {
+        dynamic_command_cap = dynamic_command_cap ? dynamic_command_cap * 2 : 16;
+        dynamic_commands = command_alloc(dynamic_commands,
+                                         sizeof(*dynamic_commands) * (size_t)dynamic_command_cap);
+    }
+    command_def_t *cmd = command_alloc(NULL, sizeof(*cmd));
+    cmd->name = strdup(name);
+    cmd->handler = handler;
+    cmd->help = strdup(help ? help : "");
+    cmd->min_args = min_args;
+    cmd->max_args = max_args;
+    if (!cmd->name || !cmd->help) {
+        perror("Out of memory");
+        exit(1);
+    }
+    dynamic_commands[dynamic_command_count++] = cmd;
+    command_index_add(cmd);
 
     return 1;
 }
 
 void command_unregister_all_dynamic(void) {
     for (int i = 0; i < dynamic_command_count; i++) {
-        free((char*)dynamic_commands[i].name);
-        free((char*)dynamic_commands[i].help);
+        free((char*)dynamic_commands[i]->name);
+        free((char*)dynamic_commands[i]->help);
+        free(dynamic_commands[i]);
     }
-    dynamic_command_count = 0;
+    free(dynamic_commands);
+    dynamic_commands = NULL;
+    dynamic_command_count = dynamic_command_cap = 0;
+
+    /* Rebuilt, of the builtins alone, on the next lookup */
+    free(command_table);
+    free(command_sorted);
+    command_table = NULL;
+    command_sorted = NULL;
+    command_table_size = 0;
+    command_index_count = command_sorted_cap = 0;
+    command_index_valid = 0;
 }
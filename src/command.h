@@ -11,7 +11,6 @@
 
 /* Command input buffer size */
 #define COMMAND_BUFFER_SIZE 256
-#define COMMAND_HISTORY_MAX 50
 
 /* Command handler function signature
  * ctx: Editor context
@@ -50,21 +49,28 @@ void command_mode_handle_key(editor_ctx_t *ctx, int fd, int key);
 int command_execute(editor_ctx_t *ctx, const char *cmdline);
 
 /* Register custom command (for Lua integration)
- * Returns: 1 on success, 0 on failure (already exists or registry full) */
+ * Returns: 1 on success, 0 on failure (already exists) */
 int command_register(const char *name, command_handler_t handler,
                      const char *help, int min_args, int max_args);
 
+/* Commands whose names start with 'prefix', in name order (for completion);
+ * the first 'max' are stored in 'out'
+ * Returns: how many there are in all */
+int command_complete(const char *prefix, const command_def_t **out, int max);
+
 /* Unregister all dynamic commands (cleanup) */
 void command_unregister_all_dynamic(void);
 
 /* Get command history entry by index (0 = oldest)
- * Returns: NULL if index out of bounds */
+ * Returns: NULL if index out of bounds
+ * The history is kept in .loki/cmd_history.log (see history.h), shared
+ * with other loki processes. */
 const char* command_history_get(int index);
 
 /* Get command history length */
 int command_history_len(void);
 
-/* Free all command history (cleanup) */
+/* Close the command history (cleanup) */
 void command_history_free(void);
 
 /* ======================== Built-in Command Handlers ======================== */
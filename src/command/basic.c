@@ -6,6 +6,15 @@
 #include "command_impl.h"
 #include "../live_loop.h"
 #include "../lang_bridge.h"
+#include "../terminal.h"
+#include "../frame_pacer.h"
+#include "../lua_gc.h"
+#include "../search_index.h"
+#include "../buffers.h"
+#include "../selection.h"
+#include "../perfhud.h"
+#include "../autocmd.h"
+#include "../spell.h"
 
 /* :q, :quit - Quit editor */
 int cmd_quit(editor_ctx_t *ctx, const char *args) {
@@ -36,7 +45,11 @@ int cmd_write_quit(editor_ctx_t *ctx, const char *args) {
         return 0;
     }
 
-    /* Then quit */
+    /* Then quit, once the data is on disk */
+    editor_save_wait(&ctx->model);
+    if (ctx->model.dirty) {
+        return 0;  /* The background save failed */
+    }
     exit(0);
 }
 
@@ -64,7 +77,7 @@ int cmd_help(editor_ctx_t *ctx, const char *args) {
 int cmd_set(editor_ctx_t *ctx, const char *args) {
     if (!args || !args[0]) {
         /* Show current settings */
-        editor_set_status_msg(ctx, "Options: wrap");
+        editor_set_status_msg(ctx, "Options: wrap, hlsearch, ignorecase, smartcase, searchindex, sync=on|off|auto, fps=N, updatetime=N, spell, spellfile=PATH, buffermem=N[k|m|g], spill=map|pack, luagc=auto|idle|burst, luagcburst=N[k|m], clipmax=N[k|m]");
         return 1;
     }
 
@@ -72,9 +85,148 @@ int cmd_set(editor_ctx_t *ctx, const char *args) {
     char option[64] = {0};
     char value[64] = {0};
 
-    if (sscanf(args, "%63s = %63s", option, value) == 2 ||
-        sscanf(args, "%63s=%63s", option, value) == 2) {
+    if (sscanf(args, "%63[^= ] = %63s", option, value) == 2) {
         /* Set option to value */
+        if (strcmp(option, "sync") == 0) {
+            /* Synchronized terminal output (DEC mode 2026) */
+            int mode;
+            if (strcmp(value, "on") == 0) mode = TERM_SYNC_ON;
+            else if (strcmp(value, "off") == 0) mode = TERM_SYNC_OFF;
+            else if (strcmp(value, "auto") == 0) mode = TERM_SYNC_AUTO;
+            else {
+                editor_set_status_msg(ctx, "sync must be on, off or auto");
+                return 0;
+            }
+            terminal_set_sync_mode(mode);
+            editor_set_status_msg(ctx, "Synchronized output: %s%s", value,
+                                  terminal_sync_enabled() ? "" : " (inactive)");
+            return 1;
+        }
+        if (strcmp(option, "fps") == 0) {
+            /* Frame rate cap for screen updates, 0 for none */
+            char *end;
+            long fps = strtol(value, &end, 10);
+            if (*end != '\0' || fps < 0 || fps > FRAME_RATE_MAX) {
+                editor_set_status_msg(ctx, "fps must be 0..%d", FRAME_RATE_MAX);
+                return 0;
+            }
+            frame_pacer_set_rate((int)fps);
+            if (fps == 0)
+                editor_set_status_msg(ctx, "Frame rate: unlimited");
+            else
+                editor_set_status_msg(ctx, "Frame rate: %ld fps", fps);
+            return 1;
+        }
+        if (strcmp(option, "updatetime") == 0) {
+            /* Quiet before CursorHold autocommands run, ms */
+            char *end;
+            long ms = strtol(value, &end, 10);
+            if (*end != '\0' || ms < 1 || ms > INT32_MAX) {
+                editor_set_status_msg(ctx, "updatetime must be a number of ms, 1 or more");
+                return 0;
+            }
+            autocmd_set_hold_ms((int)ms);
+            editor_set_status_msg(ctx, "updatetime: %ld ms", ms);
+            return 1;
+        }
+        if (strcmp(option, "spellfile") == 0) {
+            /* Word list of the spell checker, one word a line */
+            spell_set_file(value);
+            if (ctx->model.spell && spell_enable(ctx) != 0) {
+                spell_disable(ctx);
+                return 0;
+            }
+            editor_set_status_msg(ctx, "Spell file: %s", value);
+            return 1;
+        }
+        if (strcmp(option, "buffermem") == 0) {
+            /* Memory budget for the rows of loaded buffers, 0 for none */
+            char *end;
+            unsigned long long bytes = strtoull(value, &end, 10);
+            unsigned long long scale = 1;
+            if (*end == 'k' || *end == 'K') scale = 1024ULL;
+            else if (*end == 'm' || *end == 'M') scale = 1024ULL * 1024;
+            else if (*end == 'g' || *end == 'G') scale = 1024ULL * 1024 * 1024;
+            if (end == value || value[0] == '-' ||
+                (scale > 1 ? end[1] != '\0' : *end != '\0') ||
+                bytes > (unsigned long long)SIZE_MAX / scale) {
+                editor_set_status_msg(ctx, "buffermem must be a size, like 512m or 0");
+                return 0;
+            }
+            buffers_set_memory_budget((size_t)(bytes * scale));
+            if (bytes == 0)
+                editor_set_status_msg(ctx, "Buffer memory: unlimited");
+            else
+                editor_set_status_msg(ctx, "Buffer memory: %s", value);
+            return 1;
+        }
+        if (strcmp(option, "spill") == 0) {
+            /* What modified background buffers are spilled to */
+            if (strcmp(value, "map") == 0) buffers_set_spill_packed(0);
+            else if (strcmp(value, "pack") == 0) buffers_set_spill_packed(1);
+            else {
+                editor_set_status_msg(ctx, "spill must be map or pack");
+                return 0;
+            }
+            editor_set_status_msg(ctx, "Spilled buffers: %s snapshots",
+                                  buffers_get_spill_packed() ? "packed" : "mapped");
+            return 1;
+        }
+        if (strcmp(option, "luagc") == 0) {
+            /* When the Lua collector runs: Lua's schedule, plus idle time,
+             * or also not during input bursts */
+            LuaGcMode mode;
+            if (strcmp(value, "auto") == 0) mode = LUA_GC_AUTO;
+            else if (strcmp(value, "idle") == 0) mode = LUA_GC_IDLE;
+            else if (strcmp(value, "burst") == 0) mode = LUA_GC_BURST;
+            else {
+                editor_set_status_msg(ctx, "luagc must be auto, idle or burst");
+                return 0;
+            }
+            lua_gc_set_mode(mode);
+            editor_set_status_msg(ctx, "Lua collection: %s", value);
+            return 1;
+        }
+        if (strcmp(option, "luagcburst") == 0) {
+            /* Heap growth allowed with the collector stopped, 0 to not stop it */
+            char *end;
+            unsigned long long bytes = strtoull(value, &end, 10);
+            unsigned long long scale = 1;
+            if (*end == 'k' || *end == 'K') scale = 1024ULL;
+            else if (*end == 'm' || *end == 'M') scale = 1024ULL * 1024;
+            if (end == value || value[0] == '-' ||
+                (scale > 1 ? end[1] != '\0' : *end != '\0') ||
+                bytes > (unsigned long long)SIZE_MAX / scale) {
+                editor_set_status_msg(ctx, "luagcburst must be a size, like 8m or 0");
+                return 0;
+            }
+            lua_gc_set_burst_limit((size_t)(bytes * scale));
+            if (bytes == 0)
+                editor_set_status_msg(ctx, "Lua collector: runs during input");
+            else
+                editor_set_status_msg(ctx, "Lua collector: stopped during input for up to %s", value);
+            return 1;
+        }
+        if (strcmp(option, "clipmax") == 0) {
+            /* Largest selection sent to the terminal's clipboard, 0 for none */
+            char *end;
+            unsigned long long bytes = strtoull(value, &end, 10);
+            unsigned long long scale = 1;
+            if (*end == 'k' || *end == 'K') scale = 1024ULL;
+            else if (*end == 'm' || *end == 'M') scale = 1024ULL * 1024;
+            if (end == value || value[0] == '-' ||
+                (scale > 1 ? end[1] != '\0' : *end != '\0') ||
+                bytes > (unsigned long long)SIZE_MAX / scale) {
+                editor_set_status_msg(ctx, "clipmax must be a size, like 100k or 0");
+                return 0;
+            }
+            selection_set_clipboard_max((size_t)(bytes * scale));
+            if (bytes == 0)
+                editor_set_status_msg(ctx, "Clipboard copies: unlimited");
+            else
+                editor_set_status_msg(ctx, "Clipboard copies: up to %s", value);
+            return 1;
+        }
         editor_set_status_msg(ctx, "Set %s=%s (not implemented yet)", option, value);
         return 1;
     } else if (sscanf(args, "%63s", option) == 1) {
@@ -84,6 +236,42 @@ int cmd_set(editor_ctx_t *ctx, const char *args) {
             editor_set_status_msg(ctx, "Word wrap: %s",
                                  ctx->view.word_wrap ? "on" : "off");
             return 1;
+        } else if (strcmp(option, "hlsearch") == 0) {
+            ctx->view.hl_search = !ctx->view.hl_search;
+            editor_set_status_msg(ctx, "Highlight all matches: %s",
+                                 ctx->view.hl_search ? "on" : "off");
+            return 1;
+        } else if (strcmp(option, "ignorecase") == 0) {
+            ctx->view.ignore_case = !ctx->view.ignore_case;
+            editor_set_status_msg(ctx, "Ignore case in searches: %s",
+                                 ctx->view.ignore_case ? "on" : "off");
+            return 1;
+        } else if (strcmp(option, "smartcase") == 0) {
+            /* With ignorecase: upper case in the query makes it exact */
+            ctx->view.smart_case = !ctx->view.smart_case;
+            editor_set_status_msg(ctx, "Smart case: %s",
+                                 ctx->view.smart_case ? "on" : "off");
+            return 1;
+        } else if (strcmp(option, "perfhud") == 0) {
+            /* Frame, highlight and Lua timings over the message line */
+            perfhud_set(!perfhud_enabled());
+            editor_set_status_msg(ctx, "Performance HUD: %s",
+                                 perfhud_enabled() ? "on" : "off");
+            return 1;
+        } else if (strcmp(option, "spell") == 0) {
+            /* Misspelt words of comments, strings and prose, as shown */
+            if (ctx->model.spell) spell_disable(ctx);
+            else if (spell_enable(ctx) != 0) return 0;
+            editor_set_status_msg(ctx, "Spell checking: %s",
+                                 ctx->model.spell ? "on" : "off");
+            return 1;
+        } else if (strcmp(option, "searchindex") == 0) {
+            /* Trigram index of this buffer, built in the background */
+            if (ctx->model.search_index) search_index_disable(&ctx->model);
+            else search_index_enable(&ctx->model);
+            editor_set_status_msg(ctx, "Search index: %s",
+                                 ctx->model.search_index ? "on" : "off");
+            return 1;
         } else {
             editor_set_status_msg(ctx, "Unknown option: %s", option);
             return 0;
@@ -126,6 +314,8 @@ int cmd_play(editor_ctx_t *ctx, const char *args) {
     if (ret == 0) {
         editor_set_status_msg(ctx, "%s: playing", lang->name);
         return 1;
+    } else if (ret == 1) {
+        return 1;   /* On the worker; it reports when done */
     } else {
         const char *err = loki_lang_get_error(ctx);
         editor_set_status_msg(ctx, "%s error: %s", lang->name,
@@ -172,6 +362,8 @@ int cmd_eval(editor_ctx_t *ctx, const char *args) {
     if (ret == 0) {
         editor_set_status_msg(ctx, "%s: evaluated", lang->name);
         return 1;
+    } else if (ret == 1) {
+        return 1;   /* On the worker; it reports when done */
     } else {
         const char *err = loki_lang_get_error(ctx);
         editor_set_status_msg(ctx, "%s error: %s", lang->name,
@@ -0,0 +1,106 @@
+/* columns.c - Column mode for CSV and TSV files (:columns)
+ *
+ * :columns turns column mode on, split at the delimiter the file's name
+ * suggests (',' unless it ends in .tsv or .tab), or at the one given:
+ * ',', ';', '|' or "tab". :columns off turns it off. :[range]columns
+ * select N puts a cursor at the start of field N of every row of the
+ * range (or the buffer), for editing a column at once. See columns.h.
+ */
+
+#include "command_impl.h"
+#include "../columns.h"
+#include "../multicursor.h"
+
+/* Delimiter named by 'arg', or 0 */
+static char parse_delim(const char *arg) {
+    if (strcmp(arg, "tab") == 0 || strcmp(arg, "\\t") == 0) return '\t';
+    if (strcmp(arg, ",") == 0 || strcmp(arg, ";") == 0 || strcmp(arg, "|") == 0)
+        return arg[0];
+    return 0;
+}
+
+/* :[range]columns select N - A cursor at field N of rows first..last */
+static int select_column(editor_ctx_t *ctx, int first, int last, const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > COLUMNS_MAX) {
+        editor_set_status_msg(ctx, "Usage: :[range]columns select N");
+        return 0;
+    }
+    if (ctx->model.columns == NULL) {
+        editor_set_status_msg(ctx, "Column mode is off (:columns)");
+        return 0;
+    }
+    if (first < 0 || first > last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "Invalid range");
+        return 0;
+    }
+
+    columns_index_rows(ctx->model.columns, ctx->model.row, first, last);
+    multicursor_clear(ctx);
+    int made = 0;
+    for (int r = first; r <= last; r++) {
+        const t_erow *row = &ctx->model.row[r];
+        int len;
+        int start = columns_field(ctx->model.columns, r, row->chars, row->size,
+                                  (int)n - 1, &len);
+        if (start < 0) continue;
+        /* Rows in order, so each cursor goes last */
+        if (made++ == 0) editor_cursor_to(ctx, r, start);
+        else multicursor_add(ctx, r, start);
+    }
+    if (made == 0) {
+        editor_set_status_msg(ctx, "No rows with column %ld", n);
+        return 0;
+    }
+    editor_set_status_msg(ctx, "%d cursor%s in column %ld", made, made > 1 ? "s" : "", n);
+    return 1;
+}
+
+/* :[range]columns [delim|off|select N] */
+int cmd_columns_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    const char *arg = args ? args : "";
+    while (isspace((unsigned char)*arg)) arg++;
+    if (strncmp(arg, "select", 6) == 0 && (arg[6] == '\0' || isspace((unsigned char)arg[6]))) {
+        arg += 6;
+        while (isspace((unsigned char)*arg)) arg++;
+        return select_column(ctx, first, last, arg);
+    }
+
+    if (strcmp(arg, "off") == 0) {
+        columns_free(ctx->model.columns);
+        ctx->model.columns = NULL;
+        editor_set_status_msg(ctx, "Column mode off");
+        return 1;
+    }
+
+    char delim = ',';
+    if (*arg) {
+        delim = parse_delim(arg);
+        if (delim == 0) {
+            editor_set_status_msg(ctx, "Usage: :columns [,|;|||tab|off|select N]");
+            return 0;
+        }
+    } else if (columns_delim_for_path(ctx->model.filename)) {
+        delim = columns_delim_for_path(ctx->model.filename);
+    }
+
+    ColumnIndex *ci = columns_new(delim);
+    if (ci == NULL) {
+        editor_set_status_msg(ctx, "Out of memory");
+        return 0;
+    }
+    columns_free(ctx->model.columns);
+    ctx->model.columns = ci;
+    /* Fields are lined up along one screen row each */
+    ctx->view.word_wrap = 0;
+    if (delim == '\t') editor_set_status_msg(ctx, "Column mode on, split at TAB");
+    else editor_set_status_msg(ctx, "Column mode on, split at '%c'", delim);
+    return 1;
+}
+
+/* :columns [delim|off|select N] - The same over the whole buffer */
+int cmd_columns(editor_ctx_t *ctx, const char *args) {
+    return cmd_columns_range(ctx, 0, ctx->model.numrows - 1, args);
+}
@@ -31,11 +31,15 @@
 #include "../internal.h"
 #include "../command.h"
 #include "../buffers.h"
+#include "../save.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 
+struct abuf;
+struct SearchRanges;
+
 /* ======================== File Commands (file.c) ======================== */
 
 /* :w, :write - Save file */
@@ -43,6 +47,14 @@ int cmd_write(editor_ctx_t *ctx, const char *args);
 
 /* :e, :edit - Open file */
 int cmd_edit(editor_ctx_t *ctx, const char *args);
+int cmd_view(editor_ctx_t *ctx, const char *args);
+
+/* :split - Show the current buffer in a new tab too */
+int cmd_split(editor_ctx_t *ctx, const char *args);
+
+/* :follow [rows|off] - Follow the file as it grows (see follow.h) */
+int cmd_follow(editor_ctx_t *ctx, const char *args);
+int cmd_reload(editor_ctx_t *ctx, const char *args);
 
 /* ======================== Basic Commands (basic.c) ======================== */
 
@@ -80,6 +92,173 @@ int cmd_goto(editor_ctx_t *ctx, const char *args);
 /* :s/old/new/[g] - Search and replace on current line */
 int cmd_substitute(editor_ctx_t *ctx, const char *args);
 
+/* :N,Ms/old/new/[g] - Search and replace on rows first..last (0-based) */
+int cmd_substitute_range(editor_ctx_t *ctx, int first, int last,
+                         const char *pattern);
+
+/* :g/re/s/old/new/[g] - Search and replace on the rows in 'lines' */
+int cmd_substitute_lines(editor_ctx_t *ctx, const struct SearchRanges *lines,
+                         const char *pattern);
+
+/* Copy 'p' up to the next unescaped 'delim' into 'out', as the parts of
+ * s/old/new/ and /re/ are read. Backslashes stay, except the one before
+ * 'delim'. Returns the end. */
+const char *command_parse_delimited(const char *p, char delim, struct abuf *out);
+
+/* ======================== Line Commands (global.c) ======================== */
+
+/* :[range]d [count] - Delete the current line, or the lines of a range */
+int cmd_delete(editor_ctx_t *ctx, const char *args);
+int cmd_delete_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* :[range]g/re/cmd, :[range]v/re/cmd - Run 'cmd' (d, or s/old/new/) on
+ * the lines matching 're', or on those not matching it, in one pass */
+int cmd_global(editor_ctx_t *ctx, const char *args);
+int cmd_global_range(editor_ctx_t *ctx, int first, int last, const char *args);
+int cmd_vglobal(editor_ctx_t *ctx, const char *args);
+int cmd_vglobal_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* ======================== Indentation (reindent.c) ======================== */
+
+/* :[range]reindent - Reindent the whole buffer, or the lines of a range */
+int cmd_reindent(editor_ctx_t *ctx, const char *args);
+int cmd_reindent_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* ======================== Sorting (sort.c) ================================ */
+
+/* :[range]sort [n][r][u] - Sort the whole buffer, or the lines of a range */
+int cmd_sort(editor_ctx_t *ctx, const char *args);
+int cmd_sort_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* ======================== Column mode (columns.c) ========================= */
+
+/* :[range]columns [delim|off|select N] - Line up the fields of CSV/TSV
+ * rows, or put a cursor down a column */
+int cmd_columns(editor_ctx_t *ctx, const char *args);
+int cmd_columns_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* ======================== Folding (fold.c) ================================ */
+
+/* :[range]fold - Fold the lines of a range, closed */
+int cmd_fold(editor_ctx_t *ctx, const char *args);
+int cmd_fold_range(editor_ctx_t *ctx, int first, int last, const char *args);
+
+/* :foldopen, :foldclose - Open or close the fold at the cursor */
+int cmd_foldopen(editor_ctx_t *ctx, const char *args);
+int cmd_foldclose(editor_ctx_t *ctx, const char *args);
+
+/* :foldindent, :foldsyntax - Fold by indentation, or by the syntax tree */
+int cmd_foldindent(editor_ctx_t *ctx, const char *args);
+int cmd_foldsyntax(editor_ctx_t *ctx, const char *args);
+
+/* :foldclear - Remove every fold */
+int cmd_foldclear(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Preview (preview.c) ============================= */
+
+/* :preview [port|stop] - Serve the buffer rendered as Markdown, live */
+int cmd_preview(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Search Commands (grep.c) ======================== */
+
+/* :grep [-F] [-i] pattern [path] - Search the files under path */
+int cmd_grep(editor_ctx_t *ctx, const char *args);
+
+/* :bsearch [-F] [-i] pattern - Search every open buffer */
+int cmd_bsearch(editor_ctx_t *ctx, const char *args);
+
+/* :bsnext, :bsprev - Step through the matches of :bsearch */
+int cmd_bsnext(editor_ctx_t *ctx, const char *args);
+int cmd_bsprev(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Diff Commands (diff.c) ======================== */
+
+/* :diff [N|next|prev|off] - Diff buffer N, or the saved file, against this
+ * buffer; step through the hunks; or end the diff */
+int cmd_diff(editor_ctx_t *ctx, const char *args);
+
+/* ======================= Filter Commands (filter.c) ======================= */
+
+/* :!  - Stop the filter running, putting the rows back (a command needs
+ * a range) */
+int cmd_filter(editor_ctx_t *ctx, const char *cmd);
+
+/* :[range]!cmd - Replace the lines of the range with what 'cmd' makes of
+ * them */
+int cmd_filter_range(editor_ctx_t *ctx, int first, int last, const char *cmd);
+
+/* ===================== Language Server Commands (lsp.c) ===================== */
+
+/* :lsp [cmd|off|hover] - Start a language server for the buffer, stop it,
+ * ask it what is at the cursor, or say how it is */
+int cmd_lsp(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Symbol Index Commands (tag.c) ======================== */
+
+/* :tag [name] - Go to the definition of 'name' (the next one, when asked
+ * again), or say what the index holds */
+int cmd_tag(editor_ctx_t *ctx, const char *args);
+
+/* :tag! - Index the files changed outside the editor */
+int cmd_tag_refresh(editor_ctx_t *ctx, const char *args);
+
+/* ======================== File Finder Commands (find.c) ======================== */
+
+/* :find [query] - Open the file best matching 'query', or say how many
+ * files are listed */
+int cmd_find(editor_ctx_t *ctx, const char *args);
+
+/* :find! - Walk the tree again for files changed outside the editor */
+int cmd_find_refresh(editor_ctx_t *ctx, const char *args);
+
+/* While ":find query" is typed, show the best matches after it */
+void find_preview(editor_ctx_t *ctx);
+
+/* Tab on ":find query": complete the query to the best match. Returns 1
+ * if the command line was a :find, 0 otherwise. */
+int find_complete(editor_ctx_t *ctx);
+
+/* ======================== Statistics Commands (stats.c) ======================== */
+
+/* :stats async|gc [reset] - Show async event or Lua collector timings in a
+ * buffer, or clear them */
+int cmd_stats(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Profiling Commands (profile.c) ======================== */
+
+/* :profile lua [start [N] | stop | reset | dump FILE] - Show where Lua
+ * time goes, drive the sampler, or write its folded stacks */
+int cmd_profile(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Undo Commands (undo.c) ======================== */
+
+/* :undo [N] - Undo one group, or go to the state after group N */
+int cmd_undo(editor_ctx_t *ctx, const char *args);
+
+/* :redo - Redo the group last undone */
+int cmd_redo(editor_ctx_t *ctx, const char *args);
+
+/* :earlier, :later [N | N{s,m,h,d}] - Move through the undo states in the
+ * order they were made */
+int cmd_earlier(editor_ctx_t *ctx, const char *args);
+int cmd_later(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Session Commands (session.c) ======================== */
+
+/* :mksession [file] - Write the open buffers to a session file */
+int cmd_mksession(editor_ctx_t *ctx, const char *args);
+
+/* :session [file] - Open the buffers of a session file */
+int cmd_session(editor_ctx_t *ctx, const char *args);
+
+/* ======================== Recovery Commands (recover.c) ======================== */
+
+/* :recover - Replay the unsaved changes left behind for this file */
+int cmd_recover(editor_ctx_t *ctx, const char *args);
+
+/* :recover! - Delete the unsaved changes left behind for this file */
+int cmd_recover_discard(editor_ctx_t *ctx, const char *args);
+
 /* ======================== Audio Commands (link.c) ======================== */
 
 /* :link - Toggle Ableton Link */
@@ -0,0 +1,94 @@
+/* diff.c - Diff commands (:diff)
+ *
+ * :diff N diffs buffer N (the old text) against this one, and :diff alone
+ * against this buffer's file as last saved, read into a new buffer.
+ * :diff next and :diff prev step from hunk to hunk, and :diff off ends it.
+ * See diffview.h.
+ */
+
+#include "command_impl.h"
+#include "../diffview.h"
+#include "../loader.h"
+#include "../syntax.h"
+#include <errno.h>
+
+/* A new buffer holding 'ctx's file as it is on disk. Returns its id, or
+ * -1 with the reason in the status. */
+static int open_saved(editor_ctx_t *ctx) {
+    const char *filename = ctx->model.filename;
+    if (filename == NULL) {
+        editor_set_status_msg(ctx, "No file to diff against (:diff N for a buffer)");
+        return -1;
+    }
+
+    LoadedFile file = {0};
+    LineIndex index = {0};
+    if (loader_open(filename, &file) == -1 ||
+        loader_index_lines(file.data, file.size, &index) == -1) {
+        editor_set_status_msg(ctx, "Cannot read %s: %s", filename, strerror(errno));
+        loader_close(&file);
+        return -1;
+    }
+    if (index.binary) {
+        editor_set_status_msg(ctx, "Cannot diff a binary file");
+        loader_index_free(&index);
+        loader_close(&file);
+        return -1;
+    }
+
+    int id = buffer_create(NULL);
+    editor_ctx_t *saved = id >= 0 ? buffer_get(id) : NULL;
+    if (saved == NULL) {
+        editor_set_status_msg(ctx, "Can't open a buffer for the saved file");
+        loader_index_free(&index);
+        loader_close(&file);
+        return -1;
+    }
+    editor_append_lines(saved, &file, &index);
+    if (saved->model.numrows > 1) editor_del_rows(saved, 0, 1);
+    loader_index_free(&index);
+    loader_close(&file);
+    saved->model.dirty = 0;
+    syntax_select_for_filename(saved, (char *)filename);
+    return id;
+}
+
+/* :diff [N|next|prev|off] - Diff buffer N, or the saved file, against this
+ * buffer; step through the hunks; or end the diff */
+int cmd_diff(editor_ctx_t *ctx, const char *args) {
+    if (args && strcmp(args, "off") == 0) {
+        if (ctx->model.diff == NULL) {
+            editor_set_status_msg(ctx, "Not in a diff");
+            return 0;
+        }
+        diffview_stop(&ctx->model);
+        editor_set_status_msg(ctx, "Diff ended");
+        return 1;
+    }
+    if (args && strcmp(args, "next") == 0) return diffview_jump(ctx, 1) == 0;
+    if (args && strcmp(args, "prev") == 0) return diffview_jump(ctx, -1) == 0;
+
+    editor_ctx_t *old;
+    if (args && args[0]) {
+        char *end;
+        long id = strtol(args, &end, 10);
+        if (end == args || *end) {
+            editor_set_status_msg(ctx, "Usage: :diff [N|next|prev|off]");
+            return 0;
+        }
+        old = buffer_get((int)id);
+        if (old == NULL) {
+            editor_set_status_msg(ctx, "No buffer %ld", id);
+            return 0;
+        }
+    } else {
+        if (ctx->model.diff) {
+            editor_set_status_msg(ctx, "Already in a diff (:diff off ends it)");
+            return 0;
+        }
+        int id = open_saved(ctx);
+        if (id == -1) return 0;
+        old = buffer_get(id);
+    }
+    return diffview_start(old, ctx) == 0;
+}
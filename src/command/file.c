@@ -1,12 +1,18 @@
-/* file.c - File operation commands (:w, :e)
+/* file.c - File operation commands (:w, :e, :split)
  *
- * Commands for saving and opening files.
+ * Commands for saving and opening files, showing one in two tabs, and
+ * following one as it grows or reloading it.
  */
 
 #include "command_impl.h"
+#include "../follow.h"
+#include "../reload.h"
+#include <limits.h>
 
 /* :w, :write - Save file */
 int cmd_write(editor_ctx_t *ctx, const char *args) {
+    if (editor_refuse_edit(ctx)) return 0;
+
     /* Use provided filename or current filename */
     if (args && args[0]) {
         /* Save to new filename */
@@ -14,6 +20,8 @@ int cmd_write(editor_ctx_t *ctx, const char *args) {
             free(ctx->model.filename);
         }
         ctx->model.filename = strdup(args);
+        ctx->model.lang.gen = 0;
+        editor_view_reset_derived(&ctx->view);
 
         /* Update buffer display name */
         buffer_update_display_name(buffer_get_current_id());
@@ -24,6 +32,12 @@ int cmd_write(editor_ctx_t *ctx, const char *args) {
         return 0;
     }
 
+    /* In the running editor the save happens in the background and its
+     * completion handler reports the result on the status line. */
+    if (async_queue_global() != NULL) {
+        return editor_save_async(ctx) == 0;
+    }
+
     /* Save file using existing editor_save() */
     int len = editor_save(ctx);
     if (len >= 0) {
@@ -44,6 +58,21 @@ int cmd_edit(editor_ctx_t *ctx, const char *args) {
         return 0;
     }
 
+    /* Shown by another buffer too: this one moves to the file, and the
+     * document stays with the other */
+    int id = buffer_get_current_id();
+    if (buffer_view_count(id) > 1) {
+        int new_id = buffer_create(args);
+        if (new_id < 0) {
+            editor_set_status_msg(ctx, "Can't open \"%s\"", args);
+            return 0;
+        }
+        buffer_switch(new_id);
+        buffer_close(id, 1);
+        editor_set_status_msg(buffer_get_current(), "\"%s\" loaded", args);
+        return 1;
+    }
+
     if (ctx->model.dirty) {
         editor_set_status_msg(ctx, "Unsaved changes! Save first or use :q!");
         return 0;
@@ -54,3 +83,86 @@ int cmd_edit(editor_ctx_t *ctx, const char *args) {
     editor_set_status_msg(ctx, "\"%s\" loaded", args);
     return 1;
 }
+
+/* :view [file] - Show the file, or this buffer's file, read-only a window
+ * at a time (see lazy.h) */
+int cmd_view(editor_ctx_t *ctx, const char *args) {
+    const char *name = args && args[0] ? args : ctx->model.filename;
+    if (!name) {
+        editor_set_status_msg(ctx, "Filename required");
+        return 0;
+    }
+    if (ctx->model.dirty) {
+        editor_set_status_msg(ctx, "Unsaved changes! Save first or use :q!");
+        return 0;
+    }
+
+    /* The name is freed by the open when it is the buffer's own */
+    char *copy = strdup(name);
+    if (!copy) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int ok = editor_open_view(ctx, copy) == 0;
+    free(copy);
+    return ok;
+}
+
+/* :split - Show this buffer in a new tab too, with its own cursor */
+int cmd_split(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+
+    int id = buffer_create_view(buffer_get_current_id());
+    if (id < 0) {
+        editor_set_status_msg(ctx, "No buffer list to add a tab to");
+        return 0;
+    }
+    buffer_switch(id);
+    editor_set_status_msg(buffer_get_current(), "Buffer %d shows the same file", id);
+    return 1;
+}
+
+/* :follow [rows|off] - Follow the file as it grows, keeping at most 'rows'
+ * rows if given */
+int cmd_follow(editor_ctx_t *ctx, const char *args) {
+    if (args && strcmp(args, "off") == 0) {
+        if (!ctx->model.follow) {
+            editor_set_status_msg(ctx, "Not following the file");
+            return 0;
+        }
+        follow_stop(&ctx->model);
+        reload_watch(ctx);
+        editor_set_status_msg(ctx, "Stopped following the file");
+        return 1;
+    }
+
+    int max_rows = 0;
+    if (args && args[0]) {
+        char *end;
+        long n = strtol(args, &end, 10);
+        if (end == args || *end || n < 1 || n > INT_MAX) {
+            editor_set_status_msg(ctx, "Usage: :follow [rows|off]");
+            return 0;
+        }
+        max_rows = (int)n;
+    }
+    int following = ctx->model.follow != NULL;
+    if (follow_start(ctx, max_rows) != 0) return 0;
+    if (following) {
+        if (max_rows) editor_set_status_msg(ctx, "Keeping the last %d rows", max_rows);
+        else editor_set_status_msg(ctx, "Keeping every row");
+    }
+    return 1;
+}
+
+/* :reload - Patch the buffer to the file on disk, unsaved changes or not:
+ * undo brings them back */
+int cmd_reload(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    int rows = reload_from_disk(ctx);
+    if (rows == -1) return 0;
+    if (rows == 0) editor_set_status_msg(ctx, "The buffer is the file already");
+    else editor_set_status_msg(ctx, "Reloaded: %d line%s updated", rows,
+                               rows == 1 ? "" : "s");
+    return 1;
+}
@@ -0,0 +1,25 @@
+/* filter.c - Filter commands (:[range]!cmd)
+ *
+ * :%!sort, :10,20!fmt and the like replace the lines with the output of
+ * the command, which reads them on its stdin; :! alone stops a filter
+ * running. See filter.h.
+ */
+
+#include "command_impl.h"
+#include "../filter.h"
+
+int cmd_filter(editor_ctx_t *ctx, const char *cmd) {
+    while (isspace((unsigned char)*cmd)) cmd++;
+    if (*cmd == '\0') return filter_cancel(ctx) == 0;
+    editor_set_status_msg(ctx, "Filter which lines? :%%!%s for all of them", cmd);
+    return 0;
+}
+
+int cmd_filter_range(editor_ctx_t *ctx, int first, int last, const char *cmd) {
+    while (isspace((unsigned char)*cmd)) cmd++;
+    if (*cmd == '\0') {
+        editor_set_status_msg(ctx, "Usage: :[range]!command");
+        return 0;
+    }
+    return filter_start(ctx, first, last, cmd) == 0;
+}
@@ -0,0 +1,124 @@
+/* find.c - File finder commands (:find, :find!)
+ *
+ * :find query opens the project file best matching query (the characters
+ * of query in order, see finder.h). While :find is typed, the best
+ * matches are shown after the command line at each key, and Tab completes
+ * the query to the best of them. :find alone says how many files the
+ * finder lists. :find! walks the tree again for files the watcher missed.
+ * The project is the directory the editor runs in, and its list is opened
+ * on first use.
+ */
+
+#include "command_impl.h"
+#include "../finder.h"
+#include <limits.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Matches shown while :find is typed; the status line fits fewer */
+#define FIND_PREVIEW_MATCHES 8
+
+static const char find_prefix[] = ":find ";
+
+static int open_finder(editor_ctx_t *ctx) {
+    if (finder_root() == NULL && finder_open(".") != 0) {
+        if (ctx) editor_set_status_msg(ctx, "Can't list the project's files");
+        return -1;
+    }
+    return 0;
+}
+
+/* The query of a ":find query" command line, or NULL */
+static const char *typed_query(editor_ctx_t *ctx) {
+    const char *cmd = ctx->view.cmd_buffer;
+    if (strncmp(cmd, find_prefix, sizeof(find_prefix) - 1) != 0) return NULL;
+    return cmd + sizeof(find_prefix) - 1;
+}
+
+/* :find [query] - Open the file best matching 'query', or say how many
+ * files are listed */
+int cmd_find(editor_ctx_t *ctx, const char *args) {
+    if (open_finder(ctx) != 0) return 0;
+    if (args == NULL || args[0] == '\0') {
+        editor_set_status_msg(ctx, "Finder: %ld files%s", finder_count(),
+                              finder_busy() ? " (listing...)" : "");
+        return 1;
+    }
+
+    FinderMatch m;
+    if (finder_find(args, &m, 1) <= 0) {
+        if (finder_busy())
+            editor_set_status_msg(ctx, "Listing files... (no match for %s yet)", args);
+        else
+            editor_set_status_msg(ctx, "No file matches %s", args);
+        return 0;
+    }
+    const char *root = finder_root();
+    char path[PATH_MAX];
+    if (strcmp(root, ".") == 0)
+        snprintf(path, sizeof(path), "%.*s", m.len, m.path);
+    else
+        snprintf(path, sizeof(path), "%s/%.*s", root, m.len, m.path);
+
+    int id = buffer_create(path);
+    if (id < 0) {
+        editor_set_status_msg(ctx, "Can't open \"%s\"", path);
+        return 0;
+    }
+    buffer_switch(id);
+    editor_set_status_msg(buffer_get(id), "\"%s\"", path);
+    return 1;
+}
+
+/* :find! - Walk the tree again for files changed outside the editor */
+int cmd_find_refresh(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    if (open_finder(ctx) != 0) return 0;
+    finder_refresh();
+    editor_set_status_msg(ctx, "Listing files under %s...", finder_root());
+    return 1;
+}
+
+/* While ":find query" is typed, show the best matches after it */
+void find_preview(editor_ctx_t *ctx) {
+    const char *query = typed_query(ctx);
+    if (query == NULL || *query == '\0' || open_finder(NULL) != 0) return;
+
+    FinderMatch m[FIND_PREVIEW_MATCHES];
+    int n = finder_find(query, m, FIND_PREVIEW_MATCHES);
+    char msg[sizeof(ctx->view.statusmsg)];
+    int len = snprintf(msg, sizeof(msg), "%s", ctx->view.cmd_buffer);
+    if (len < 0 || (size_t)len >= sizeof(msg)) return;
+    if (n <= 0) {
+        snprintf(msg + len, sizeof(msg) - (size_t)len, "  (%s)",
+                 finder_busy() ? "listing..." : "no match");
+    }
+    for (int i = 0; i < n; i++) {
+        /* Whole paths only, as many as fit */
+        size_t need = 2 + (size_t)m[i].len;
+        if ((size_t)len + need >= sizeof(msg)) break;
+        len += snprintf(msg + len, sizeof(msg) - (size_t)len, "  %.*s",
+                        m[i].len, m[i].path);
+    }
+    editor_set_status_msg(ctx, "%s", msg);
+}
+
+/* Tab on ":find query": complete the query to the best match */
+int find_complete(editor_ctx_t *ctx) {
+    const char *query = typed_query(ctx);
+    if (query == NULL || ctx->view.cmd_cursor_pos != ctx->view.cmd_length ||
+        open_finder(ctx) != 0) return 0;
+
+    FinderMatch m;
+    if (finder_find(query, &m, 1) <= 0) return 1;
+    size_t at = sizeof(find_prefix) - 1;
+    size_t len = (size_t)m.len;
+    if (at + len >= (size_t)COMMAND_BUFFER_SIZE) len = COMMAND_BUFFER_SIZE - 1 - at;
+    memcpy(ctx->view.cmd_buffer + at, m.path, len);
+    ctx->view.cmd_buffer[at + len] = '\0';
+    ctx->view.cmd_length = ctx->view.cmd_cursor_pos = (int)(at + len);
+    find_preview(ctx);
+    return 1;
+}
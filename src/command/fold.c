@@ -0,0 +1,81 @@
+/* fold.c - Folding commands (:fold, :foldopen, :foldindent, ...)
+ *
+ * :[range]fold makes a closed fold over a range, :foldopen and :foldclose
+ * open and close the fold at the cursor, :foldindent and :foldsyntax
+ * replace the folds with those of the indentation or of the syntax tree,
+ * and :foldclear removes them. The same as zf, zo, zc and zE (modal.c).
+ */
+
+#include "command_impl.h"
+#include "../fold.h"
+
+/* :[range]fold - Fold lines first..last, closed */
+int cmd_fold_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    (void)args;
+    if (first < 0 || first >= last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "A fold needs two lines or more");
+        return 0;
+    }
+    if (editor_fold_add(&ctx->model, first, last, 1) != 0) {
+        editor_set_status_msg(ctx, "Fold crosses another fold");
+        return 0;
+    }
+    editor_view_fix(ctx);
+    return 1;
+}
+
+/* :fold - Without a range there is nothing to fold */
+int cmd_fold(editor_ctx_t *ctx, const char *args) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    return cmd_fold_range(ctx, row, row, args);
+}
+
+/* :foldopen, :foldclose - Open or close the fold at the cursor */
+int cmd_foldopen(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    if (!fold_open(ctx->model.folds, ctx->view.rowoff + ctx->view.cy)) {
+        editor_set_status_msg(ctx, "No fold found");
+        return 0;
+    }
+    editor_view_fix(ctx);
+    return 1;
+}
+
+int cmd_foldclose(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    if (!fold_close(ctx->model.folds, ctx->view.rowoff + ctx->view.cy)) {
+        editor_set_status_msg(ctx, "No fold found");
+        return 0;
+    }
+    editor_view_fix(ctx);
+    return 1;
+}
+
+/* :foldindent - A closed fold per indented block */
+int cmd_foldindent(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    int made = fold_from_indent(ctx);
+    editor_view_fix(ctx);
+    editor_set_status_msg(ctx, "%d fold%s", made, made == 1 ? "" : "s");
+    return 1;
+}
+
+/* :foldsyntax - A closed fold per syntax node over several lines */
+int cmd_foldsyntax(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    int made = fold_from_syntax(ctx);
+    if (made < 0) {
+        editor_set_status_msg(ctx, "No syntax tree for this buffer");
+        return 0;
+    }
+    editor_view_fix(ctx);
+    editor_set_status_msg(ctx, "%d fold%s", made, made == 1 ? "" : "s");
+    return 1;
+}
+
+/* :foldclear - Remove every fold */
+int cmd_foldclear(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    fold_clear(ctx->model.folds);
+    return 1;
+}
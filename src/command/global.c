@@ -0,0 +1,205 @@
+/* global.c - Line deletion and the global command (:d, :g, :v)
+ *
+ * :[range]d deletes whole lines; :[range]g/re/cmd runs 'cmd' on the lines
+ * of the range (the whole buffer by default) that match 're', and :v (or
+ * :g!) on those that do not. Supported commands are d and s/old/new/.
+ *
+ * Neither moves the cursor from line to line. The lines are matched in one
+ * pass over the rows and kept as runs (SearchRanges); a delete is then one
+ * editor_replace_range() over their span, and a substitute one row update
+ * per changed row, so either is one undo step however many lines it takes.
+ */
+
+#include "command_impl.h"
+#include "../regexp.h"
+#include "../search.h"
+#include "../search_index.h"
+#include "../terminal.h"
+
+/* Replace rows first..last, whole, by the 'len' bytes at 'lines', each
+ * line of them ended by '\n' ('len' 0 deletes them), as one edit */
+static void replace_lines(editor_ctx_t *ctx, int first, int last,
+                          const char *lines, size_t len) {
+    int numrows = ctx->model.numrows;
+    if (last + 1 < numrows) {
+        editor_replace_range(ctx, first, 0, last + 1, 0, lines, len, NULL, NULL);
+    } else if (first > 0) {
+        /* The last rows go with the newline before them */
+        struct abuf text = ABUF_INIT;
+        if (len > 0) {
+            terminal_buffer_append(&text, "\n", 1);
+            terminal_buffer_append(&text, lines, (int)len - 1);
+        }
+        editor_replace_range(ctx, first - 1, ctx->model.row[first - 1].size,
+                             last, ctx->model.row[last].size,
+                             text.b ? text.b : "", (size_t)text.len, NULL, NULL);
+        terminal_buffer_free(&text);
+    } else {
+        editor_replace_range(ctx, 0, 0, last, ctx->model.row[last].size,
+                             lines, len ? len - 1 : 0, NULL, NULL);
+    }
+}
+
+/* Delete the rows in 'lines' (ascending runs, within the buffer). Returns
+ * how many went. */
+static int delete_lines(editor_ctx_t *ctx, const SearchRanges *lines) {
+    if (lines->n == 0) return 0;
+    int first = lines->r[0].first, last = lines->r[lines->n - 1].last;
+
+    /* What stays of the span: the rows between the runs */
+    struct abuf kept = ABUF_INIT;
+    for (int i = 0; i + 1 < lines->n; i++) {
+        for (int r = lines->r[i].last + 1; r < lines->r[i + 1].first; r++) {
+            const t_erow *row = &ctx->model.row[r];
+            terminal_buffer_append(&kept, row->chars, row->size);
+            terminal_buffer_append(&kept, "\n", 1);
+        }
+    }
+    int deleted = search_ranges_rows(lines);
+    replace_lines(ctx, first, last, kept.b ? kept.b : "", (size_t)kept.len);
+    terminal_buffer_free(&kept);
+
+    int row = first < ctx->model.numrows ? first : ctx->model.numrows - 1;
+    editor_cursor_to(ctx, row < 0 ? 0 : row, 0);
+    if (deleted > 1) editor_set_status_msg(ctx, "%d fewer lines", deleted);
+    return deleted;
+}
+
+/* :[range]d [count] - Delete lines first..last, or 'count' from first */
+int cmd_delete_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    if (args && *args) {
+        char *end;
+        long count = strtol(args, &end, 10);
+        if (count < 1 || *end) {
+            editor_set_status_msg(ctx, "Usage: :[range]d [count]");
+            return 0;
+        }
+        if (count > ctx->model.numrows) count = ctx->model.numrows;
+        first = last;
+        last = first + (int)count - 1;
+        if (last >= ctx->model.numrows) last = ctx->model.numrows - 1;
+    }
+    if (first < 0 || last >= ctx->model.numrows || first > last) {
+        editor_set_status_msg(ctx, "Invalid range");
+        return 0;
+    }
+    SearchRanges lines = {NULL, 0, 0};
+    search_ranges_add(&lines, first, last);
+    delete_lines(ctx, &lines);
+    search_ranges_free(&lines);
+    return 1;
+}
+
+/* :d [count] - Delete the current line, or 'count' from it */
+int cmd_delete(editor_ctx_t *ctx, const char *args) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    return cmd_delete_range(ctx, row, row, args);
+}
+
+/* Run /re/cmd on rows first..last: on those matching 're', or with
+ * 'invert' on the others */
+static int global(editor_ctx_t *ctx, int first, int last, int invert,
+                  const char *args) {
+    while (args && isspace((unsigned char)*args)) args++;
+    if (!args || *args != '/') {
+        editor_set_status_msg(ctx, "Usage: :[range]%s/re/d or /re/s/old/new/",
+                              invert ? "v" : "g");
+        return 0;
+    }
+
+    struct abuf pattern = ABUF_INIT;
+    SearchRanges rows = {NULL, 0, 0}, lines = {NULL, 0, 0};
+    Regexp *re = NULL;
+    int result = 0;
+
+    const char *p = command_parse_delimited(args + 1, '/', &pattern);
+    terminal_buffer_append(&pattern, "", 1);
+    if (*p == '/') p++;
+    while (isspace((unsigned char)*p)) p++;
+
+    if (pattern.b[0] == '\0') {
+        editor_set_status_msg(ctx, "Empty search pattern");
+        goto done;
+    }
+    if (ctx->model.numrows == 0) {
+        editor_set_status_msg(ctx, "Pattern not found: %s", pattern.b);
+        goto done;
+    }
+    if (first < 0 || first > last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "Invalid range");
+        goto done;
+    }
+    int is_delete = strcmp(p, "d") == 0 || strcmp(p, "delete") == 0;
+    int is_substitute = p[0] == 's' && p[1] == '/';
+    if (*p && !is_delete && !is_substitute) {
+        editor_set_status_msg(ctx, "Not supported after :g: %s (d, s/old/new/)", p);
+        goto done;
+    }
+
+    const char *error;
+    int icase = search_ignores_case(ctx, pattern.b, pattern.len - 1, 1);
+    re = regexp_compile(pattern.b, icase ? REGEXP_ICASE : 0, &error);
+    if (!re) {
+        editor_set_status_msg(ctx, "Invalid pattern: %s", error);
+        goto done;
+    }
+
+    /* The lines, in one pass; rows the index rules out are not matched */
+    const char *lit;
+    int litlen = regexp_required(re, &lit);
+    search_index_lookup(&ctx->model, lit, litlen, &rows);
+    int c = search_ranges_find(&rows, first);
+    for (int r = first; r <= last; r++) {
+        while (c < rows.n && rows.r[c].last < r) c++;
+        if (!invert && (c == rows.n || rows.r[c].first > r)) {
+            if (c == rows.n) break;
+            r = rows.r[c].first - 1;           /* Skip to the next */
+            continue;
+        }
+        int hit = 0, start, end;
+        if (c < rows.n && rows.r[c].first <= r) {
+            const t_erow *row = &ctx->model.row[r];
+            hit = regexp_search(re, row->chars, row->size, 0, &start, &end);
+        }
+        if (hit != invert) search_ranges_add(&lines, r, r);
+    }
+
+    if (lines.n == 0) {
+        editor_set_status_msg(ctx, "Pattern not found: %s", pattern.b);
+        goto done;
+    }
+    if (is_delete) {
+        delete_lines(ctx, &lines);
+        result = 1;
+    } else if (is_substitute) {
+        result = cmd_substitute_lines(ctx, &lines, p);
+    } else {
+        int count = search_ranges_rows(&lines);
+        editor_set_status_msg(ctx, "%d line%s", count, count > 1 ? "s" : "");
+        result = 1;
+    }
+
+done:
+    regexp_free(re);
+    search_ranges_free(&rows);
+    search_ranges_free(&lines);
+    terminal_buffer_free(&pattern);
+    return result;
+}
+
+int cmd_global_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    return global(ctx, first, last, 0, args);
+}
+
+int cmd_vglobal_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    return global(ctx, first, last, 1, args);
+}
+
+/* :g/re/cmd, :v/re/cmd - The same over the whole buffer */
+int cmd_global(editor_ctx_t *ctx, const char *args) {
+    return global(ctx, 0, ctx->model.numrows - 1, 0, args);
+}
+
+int cmd_vglobal(editor_ctx_t *ctx, const char *args) {
+    return global(ctx, 0, ctx->model.numrows - 1, 1, args);
+}
@@ -4,8 +4,11 @@
  */
 
 #include "command_impl.h"
+#include "../lazy.h"
+#include <limits.h>
 
-/* :goto, :<number> - Go to line number */
+/* :goto, :<number>, :<number>% - Go to line number, or that percentage of
+ * the way into the file */
 int cmd_goto(editor_ctx_t *ctx, const char *args) {
     if (!args || !args[0]) {
         editor_set_status_msg(ctx, "Usage: :<line> or :goto <line>");
@@ -13,11 +16,36 @@ int cmd_goto(editor_ctx_t *ctx, const char *args) {
     }
 
     /* Parse line number */
-    int line = atoi(args);
-    if (line < 1) {
+    char *end;
+    long n = strtol(args, &end, 10);
+    int percent = *end == '%';
+    if (percent) end++;
+    if (end == args || *end || n < (percent ? 0 : 1)) {
         editor_set_status_msg(ctx, "Invalid line number: %s", args);
         return 0;
     }
+    if (n > INT_MAX) n = INT_MAX;
+
+    /* A large file loads the window around the line */
+    if (ctx->model.lazy) {
+        if (percent) {
+            lazy_goto_percent(ctx, n > 100 ? 100 : (int)n);
+        } else {
+            lazy_goto(ctx, (int)n - 1);
+        }
+        int line, total;
+        editor_status_lines(ctx, &line, &total);
+        if (line > 0) editor_set_status_msg(ctx, "Line %d", line);
+        else editor_set_status_msg(ctx, "%ld%% (line not indexed yet)", n);
+        return 1;
+    }
+
+    int line = (int)n;
+    if (percent) {
+        if (n > 100) n = 100;
+        line = (int)((n * ctx->model.numrows + 99) / 100);
+        if (line < 1) line = 1;
+    }
 
     /* Clamp to valid range (1-indexed for user, 0-indexed internally) */
     if (line > ctx->model.numrows) {
@@ -25,16 +53,7 @@ int cmd_goto(editor_ctx_t *ctx, const char *args) {
     }
 
     /* Move cursor to the line (convert to 0-indexed) */
-    ctx->view.cy = line - 1;
-    ctx->view.cx = 0;
-
-    /* Adjust scroll to show the target line */
-    if (ctx->view.cy < ctx->view.rowoff) {
-        ctx->view.rowoff = ctx->view.cy;
-    } else if (ctx->view.cy >= ctx->view.rowoff + ctx->view.screenrows - 2) {
-        ctx->view.rowoff = ctx->view.cy - ctx->view.screenrows / 2;
-        if (ctx->view.rowoff < 0) ctx->view.rowoff = 0;
-    }
+    editor_cursor_to(ctx, line > 0 ? line - 1 : 0, 0);
 
     editor_set_status_msg(ctx, "Line %d", line);
     return 1;
@@ -0,0 +1,115 @@
+/* grep.c - Search commands (:grep, :bsearch)
+ *
+ * :grep searches the files under a directory for a regex and lists every
+ * matching line, as "path:line:col: text", in a new buffer (see grep.h).
+ * :bsearch searches the open buffers, and :bsnext and :bsprev step
+ * through its matches (see bsearch.h).
+ */
+
+#include "command_impl.h"
+#include "../grep.h"
+#include "../bsearch.h"
+
+/* :grep [-F] [-i] pattern [path] - Search the files under path (default
+ * "."). -F takes the pattern as plain text, -i ignores case. A pattern with
+ * spaces goes in quotes; \" inside them is a quote. */
+int cmd_grep(editor_ctx_t *ctx, const char *args) {
+    if (!args || !args[0]) {
+        editor_set_status_msg(ctx, "Usage: :grep [-F] [-i] pattern [path]");
+        return 0;
+    }
+
+    const char *p = args;
+    int flags = 0;
+    while (p[0] == '-' && (p[1] == 'F' || p[1] == 'i') &&
+           (p[2] == ' ' || p[2] == '\0')) {
+        flags |= p[1] == 'F' ? GREP_LITERAL : GREP_ICASE;
+        p += 2;
+        while (*p == ' ') p++;
+    }
+
+    /* The pattern: quoted, or up to the next space */
+    char pattern[KILO_QUERY_LEN + 1];
+    size_t len = 0;
+    if (*p == '"' || *p == '\'') {
+        char quote = *p++;
+        while (*p && *p != quote) {
+            if (*p == '\\' && p[1] == quote) p++;
+            if (len < KILO_QUERY_LEN) pattern[len++] = *p;
+            p++;
+        }
+        if (*p != quote) {
+            editor_set_status_msg(ctx, "grep: Missing closing %c", quote);
+            return 0;
+        }
+        p++;
+    } else {
+        while (*p && *p != ' ') {
+            if (len < KILO_QUERY_LEN) pattern[len++] = *p;
+            p++;
+        }
+    }
+    pattern[len] = '\0';
+    if (len == 0) {
+        editor_set_status_msg(ctx, "Usage: :grep [-F] [-i] pattern [path]");
+        return 0;
+    }
+
+    /* The rest is the path */
+    while (*p == ' ') p++;
+    char path[1024];
+    size_t plen = strlen(p);
+    while (plen && p[plen - 1] == ' ') plen--;
+    if (plen == 0) {
+        strcpy(path, ".");
+    } else if (plen < sizeof(path)) {
+        memcpy(path, p, plen);
+        path[plen] = '\0';
+    } else {
+        editor_set_status_msg(ctx, "grep: Path too long");
+        return 0;
+    }
+
+    return grep_start(ctx, pattern, path, flags) == 0;
+}
+
+/* :bsearch [-F] [-i] pattern - Search every open buffer and jump to the
+ * first match. The pattern is the rest of the line; -F takes it as plain
+ * text, -i ignores case (else :set ignorecase and smartcase decide). */
+int cmd_bsearch(editor_ctx_t *ctx, const char *args) {
+    const char *p = args ? args : "";
+    int flags = 0;
+    while (p[0] == '-' && (p[1] == 'F' || p[1] == 'i') &&
+           (p[2] == ' ' || p[2] == '\0')) {
+        flags |= p[1] == 'F' ? BSEARCH_LITERAL : BSEARCH_ICASE;
+        p += 2;
+        while (*p == ' ') p++;
+    }
+
+    char pattern[KILO_QUERY_LEN + 1];
+    size_t len = strlen(p);
+    while (len && p[len - 1] == ' ') len--;
+    if (len == 0) {
+        editor_set_status_msg(ctx, "Usage: :bsearch [-F] [-i] pattern");
+        return 0;
+    }
+    if (len > KILO_QUERY_LEN) {
+        editor_set_status_msg(ctx, "bsearch: Pattern too long");
+        return 0;
+    }
+    memcpy(pattern, p, len);
+    pattern[len] = '\0';
+    return bsearch_start(ctx, pattern, flags) == 0;
+}
+
+/* :bsnext - Jump to the next match of :bsearch */
+int cmd_bsnext(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    return bsearch_jump(ctx, 1) == 0;
+}
+
+/* :bsprev - Jump to the previous match of :bsearch */
+int cmd_bsprev(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    return bsearch_jump(ctx, -1) == 0;
+}
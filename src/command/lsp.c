@@ -0,0 +1,71 @@
+/* lsp.c - Language server commands (:lsp)
+ *
+ * :lsp cmd opens the buffer's file in the language server run by cmd (a
+ * buffer started with the same command shares it), :lsp off closes it
+ * there, :lsp hover shows the hover text at the cursor in the status, and
+ * :lsp alone the server, its diagnostics and the first on the cursor's
+ * line. See lsp.h.
+ */
+
+#include "command_impl.h"
+#include "../lsp.h"
+
+static void show_hover(editor_ctx_t *ctx, const LspResult *result, void *opaque) {
+    (void)opaque;
+    if (result->cancelled) return;
+    if (result->text == NULL) {
+        editor_set_status_msg(ctx, "Nothing to show here");
+        return;
+    }
+    const char *text = result->text;
+    while (*text == '\n') text++;
+    editor_set_status_msg(ctx, "%.*s", (int)strcspn(text, "\n"), text);
+}
+
+/* :lsp - The server and its diagnostics */
+static int show_server(editor_ctx_t *ctx) {
+    const char *server = lsp_server(&ctx->model);
+    if (server == NULL) {
+        editor_set_status_msg(ctx, "No language server (:lsp command starts one)");
+        return 0;
+    }
+    const LspDiagnostic *diags;
+    int n = lsp_diagnostics(&ctx->model, &diags);
+    int errors = 0, at = -1;
+    int row = ctx->view.rowoff + ctx->view.cy;
+    for (int i = 0; i < n; i++) {
+        if (diags[i].severity <= 1) errors++;
+        if (at < 0 && diags[i].row <= row && row <= diags[i].end_row) at = i;
+    }
+    if (at >= 0)
+        editor_set_status_msg(ctx, "%.30s: %d error%s, %d other | %s", server,
+                              errors, errors == 1 ? "" : "s", n - errors,
+                              diags[at].message);
+    else
+        editor_set_status_msg(ctx, "%.30s: %d error%s, %d other", server,
+                              errors, errors == 1 ? "" : "s", n - errors);
+    return 1;
+}
+
+/* :lsp [cmd|off|hover] - Start a language server for the buffer, stop it,
+ * ask it what is at the cursor, or say how it is */
+int cmd_lsp(editor_ctx_t *ctx, const char *args) {
+    if (args == NULL || args[0] == '\0') return show_server(ctx);
+    if (strcmp(args, "off") == 0) {
+        if (ctx->model.lsp == NULL) {
+            editor_set_status_msg(ctx, "No language server");
+            return 0;
+        }
+        lsp_stop(&ctx->model);
+        editor_set_status_msg(ctx, "Language server stopped");
+        return 1;
+    }
+    if (strcmp(args, "hover") == 0) {
+        if (lsp_request(ctx, LSP_REQ_HOVER, show_hover, NULL) == -1) {
+            editor_set_status_msg(ctx, "No language server (:lsp command starts one)");
+            return 0;
+        }
+        return 1;
+    }
+    return lsp_start(ctx, args) == 0;
+}
@@ -0,0 +1,41 @@
+/* preview.c - Markdown previews in a browser (:preview)
+ *
+ * :preview serves the buffer, rendered as Markdown, at a local URL that
+ * follows its edits (see preview.h); :preview PORT on that port, and
+ * :preview stop stops it.
+ */
+
+#include "command_impl.h"
+#include "../preview.h"
+
+/* :preview [port|stop] - Preview the buffer in a browser */
+int cmd_preview(editor_ctx_t *ctx, const char *args) {
+    while (args && isspace((unsigned char)*args)) args++;
+    if (args && strcmp(args, "stop") == 0) {
+        if (preview_port() < 0) {
+            editor_set_status_msg(ctx, "No preview running");
+        } else {
+            preview_stop();
+            editor_set_status_msg(ctx, "Preview stopped");
+        }
+        return 1;
+    }
+
+    long port = 0;
+    if (args && *args) {
+        char *end;
+        port = strtol(args, &end, 10);
+        if (*end || port < 0 || port > 65535) {
+            editor_set_status_msg(ctx, "Usage: :preview [port|stop]");
+            return 0;
+        }
+    }
+    char err[256];
+    int got = preview_start(ctx, (int)port, err, sizeof(err));
+    if (got < 0) {
+        editor_set_status_msg(ctx, "Preview failed: %s", err);
+        return 0;
+    }
+    editor_set_status_msg(ctx, "Preview at http://127.0.0.1:%d/", got);
+    return 1;
+}
@@ -0,0 +1,138 @@
+/* profile.c - Lua profiling commands (:profile lua)
+ *
+ * :profile lua lists, in a new buffer, the calls the editor made into Lua
+ * at each entry point and how long they took, and while the sampler has
+ * run, the functions it found Lua in most often (see lua_profile.h).
+ * start, stop and reset drive the sampler; dump writes its samples as
+ * folded stacks for a flame graph tool.
+ */
+
+#include "command_impl.h"
+#include "../lua_profile.h"
+#include <errno.h>
+
+/* Functions listed in the report */
+#define PROFILE_TOP 20
+
+/* Nanoseconds as a short duration */
+static const char *format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    else snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+    return buf;
+}
+
+static void add_row(editor_ctx_t *ctx, char *text) {
+    editor_insert_row(ctx, ctx->model.numrows, text, strlen(text));
+}
+
+/* The report buffer for :profile lua */
+static int show_report(editor_ctx_t *ctx) {
+    int id = buffer_create(NULL);
+    editor_ctx_t *out = id >= 0 ? buffer_get(id) : NULL;
+    if (!out) {
+        editor_set_status_msg(ctx, "profile: Can't open a buffer for the report");
+        return 0;
+    }
+    editor_del_row(out, 0);
+
+    char row[256];
+    add_row(out, "Lua entry points:");
+    int used = 0;
+    for (int e = 0; e < LUA_PROFILE_ENTRIES; e++) {
+        LuaProfileEntryStats st;
+        lua_profile_get_entry((LuaProfileEntry)e, &st);
+        if (!st.calls) continue;
+        char total[16], mean[16], max[16];
+        snprintf(row, sizeof(row), "  %-10s %8llu calls %6llu errors  total %-8s mean %-8s max %s",
+                 lua_profile_entry_name((LuaProfileEntry)e),
+                 (unsigned long long)st.calls, (unsigned long long)st.errors,
+                 format_ns(total, sizeof(total), st.total_ns),
+                 format_ns(mean, sizeof(mean), st.total_ns / st.calls),
+                 format_ns(max, sizeof(max), st.max_ns));
+        add_row(out, row);
+        used++;
+    }
+    if (used == 0) add_row(out, "  No calls into Lua yet");
+
+    uint64_t samples = lua_profile_samples();
+    snprintf(row, sizeof(row), "Sampler: %s, %llu samples",
+             lua_profile_running() ? "running" : "stopped", (unsigned long long)samples);
+    add_row(out, "");
+    add_row(out, row);
+
+    LuaProfileFunc top[PROFILE_TOP];
+    int n = samples ? lua_profile_top(top, PROFILE_TOP) : 0;
+    if (n > 0) {
+        add_row(out, "    self%   total%  function");
+        for (int i = 0; i < n; i++) {
+            snprintf(row, sizeof(row), "  %6.1f%%  %6.1f%%  %s",
+                     100.0 * (double)top[i].self / (double)samples,
+                     100.0 * (double)top[i].total / (double)samples, top[i].name);
+            add_row(out, row);
+        }
+    } else if (!lua_profile_running()) {
+        add_row(out, "  :profile lua start [N] samples every N instructions");
+    }
+
+    out->model.dirty = 0;
+    buffer_switch(id);
+    return 1;
+}
+
+/* :profile lua [start [N] | stop | reset | dump FILE] */
+int cmd_profile(editor_ctx_t *ctx, const char *args) {
+    const char *usage = "Usage: :profile lua [start [N] | stop | reset | dump FILE]";
+    if (!args || strncmp(args, "lua", 3) != 0 || (args[3] && args[3] != ' ')) {
+        editor_set_status_msg(ctx, "%s", usage);
+        return 0;
+    }
+    const char *sub = args + 3;
+    while (*sub == ' ') sub++;
+    if (!*sub) return show_report(ctx);
+
+    if (strncmp(sub, "start", 5) == 0 && (sub[5] == '\0' || sub[5] == ' ')) {
+        lua_State *L = ctx_L(ctx);
+        if (!L) {
+            editor_set_status_msg(ctx, "profile: Lua is not running");
+            return 0;
+        }
+        int interval = atoi(sub + 5);
+        if (interval <= 0) interval = LUA_PROFILE_INTERVAL;
+        if (lua_profile_start(L, interval) != 0) {
+            editor_set_status_msg(ctx, "profile: Already sampling another Lua state");
+            return 0;
+        }
+        editor_set_status_msg(ctx, "profile: Sampling Lua every %d instructions", interval);
+        return 1;
+    }
+    if (strcmp(sub, "stop") == 0) {
+        lua_profile_stop();
+        editor_set_status_msg(ctx, "profile: Stopped, %llu samples",
+                              (unsigned long long)lua_profile_samples());
+        return 1;
+    }
+    if (strcmp(sub, "reset") == 0) {
+        lua_profile_reset();
+        editor_set_status_msg(ctx, "profile: Samples and timings cleared");
+        return 1;
+    }
+    if (strncmp(sub, "dump", 4) == 0 && sub[4] == ' ') {
+        const char *path = sub + 4;
+        while (*path == ' ') path++;
+        if (!*path) {
+            editor_set_status_msg(ctx, "%s", usage);
+            return 0;
+        }
+        int stacks = lua_profile_write_folded(path);
+        if (stacks < 0) {
+            editor_set_status_msg(ctx, "profile: Can't write %s: %s", path, strerror(errno));
+            return 0;
+        }
+        editor_set_status_msg(ctx, "profile: %d stacks written to %s", stacks, path);
+        return 1;
+    }
+    editor_set_status_msg(ctx, "%s", usage);
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* recover.c - Unsaved changes left behind by a crash (:recover)
+ *
+ * Opening a file whose journal of unsaved changes was left behind says so
+ * (see recovery.h). :recover replays the journal into the buffer, which
+ * is left modified; :recover! deletes it instead. Either way the buffer's
+ * own edits are journaled again from then on.
+ */
+
+#include "command_impl.h"
+#include "../recovery.h"
+
+/* :recover - Replay the unsaved changes left behind for this file */
+int cmd_recover(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    char err[128];
+    int applied = recovery_replay(ctx, err, sizeof(err));
+    if (applied < 0) {
+        editor_set_status_msg(ctx, "recover: %s", err);
+        return 0;
+    }
+    if (ctx->view.cy + ctx->view.rowoff >= ctx->model.numrows) {
+        ctx->view.cy = ctx->view.cx = 0;
+        ctx->view.rowoff = ctx->view.coloff = 0;
+    }
+    editor_set_status_msg(ctx, "Recovered %d change%s: :w to keep them",
+                          applied, applied == 1 ? "" : "s");
+    return 1;
+}
+
+/* :recover! - Delete the unsaved changes left behind for this file */
+int cmd_recover_discard(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    if (!recovery_found(ctx)) {
+        editor_set_status_msg(ctx, "recover: No unsaved changes to recover");
+        return 0;
+    }
+    recovery_discard(ctx);
+    editor_set_status_msg(ctx, "Unsaved changes from the crash deleted");
+    return 1;
+}
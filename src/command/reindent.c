@@ -0,0 +1,32 @@
+/* reindent.c - Reindenting the buffer (:reindent)
+ *
+ * :reindent fixes the indentation of the whole buffer, :[range]reindent
+ * that of a range, by the brackets around each line (indent_reindent()).
+ * Only lines whose indentation changes are rewritten, all of them as one
+ * undo step.
+ */
+
+#include "command_impl.h"
+#include "../indent.h"
+
+/* :[range]reindent - Reindent lines first..last */
+int cmd_reindent_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    (void)args;
+    if (first < 0 || first > last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "Invalid range");
+        return 0;
+    }
+    int changed = indent_reindent(ctx, first, last);
+    if (changed == 0) editor_set_status_msg(ctx, "Indentation unchanged");
+    else editor_set_status_msg(ctx, "%d line%s reindented", changed, changed > 1 ? "s" : "");
+    return 1;
+}
+
+/* :reindent - The same over the whole buffer */
+int cmd_reindent(editor_ctx_t *ctx, const char *args) {
+    if (ctx->model.numrows == 0) {
+        editor_set_status_msg(ctx, "Indentation unchanged");
+        return 1;
+    }
+    return cmd_reindent_range(ctx, 0, ctx->model.numrows - 1, args);
+}
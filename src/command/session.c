@@ -0,0 +1,44 @@
+/* session.c - Sessions (:mksession, :session)
+ *
+ * :mksession [file] writes the open buffers to a session file, and
+ * :session [file] opens them again, SESSION_FILE_DEFAULT if not named.
+ * See session_file.h.
+ */
+
+#include "command_impl.h"
+#include "../buffers.h"
+#include "../session_file.h"
+#include <errno.h>
+#include <string.h>
+
+/* :mksession [file] - Write the open buffers to a session file */
+int cmd_mksession(editor_ctx_t *ctx, const char *args) {
+    const char *path = args && args[0] ? args : SESSION_FILE_DEFAULT;
+    int count = session_file_save(path);
+    if (count < 0) {
+        editor_set_status_msg(ctx, "Can't write session \"%s\": %s", path, strerror(errno));
+        return 0;
+    }
+    editor_set_status_msg(ctx, "Session \"%s\": %d buffer%s", path, count,
+                          count == 1 ? "" : "s");
+    return 1;
+}
+
+/* :session [file] - Open the buffers of a session file */
+int cmd_session(editor_ctx_t *ctx, const char *args) {
+    const char *path = args && args[0] ? args : SESSION_FILE_DEFAULT;
+    int missing;
+    int count = session_file_load(path, &missing);
+    if (count < 0) {
+        editor_set_status_msg(ctx, "\"%s\" is not a session", path);
+        return 0;
+    }
+    ctx = buffer_get_current();
+    if (missing > 0)
+        editor_set_status_msg(ctx, "Session \"%s\": %d buffer%s, %d file%s gone", path,
+                              count, count == 1 ? "" : "s", missing, missing == 1 ? "" : "s");
+    else
+        editor_set_status_msg(ctx, "Session \"%s\": %d buffer%s", path, count,
+                              count == 1 ? "" : "s");
+    return 1;
+}
@@ -0,0 +1,45 @@
+/* sort.c - Sorting lines (:sort)
+ *
+ * :sort [n][r][u] sorts the whole buffer, :[range]sort the lines of a
+ * range: by their text, or by the first number in each (n), in reverse
+ * (r), keeping one of each run of equal lines (u). In column mode a
+ * number, as in :sort n 3, sorts by that column. See sort.h.
+ */
+
+#include "command_impl.h"
+#include "../sort.h"
+
+/* :[range]sort [n][r][u] [column] - Sort lines first..last */
+int cmd_sort_range(editor_ctx_t *ctx, int first, int last, const char *args) {
+    int column;
+    int flags = sort_parse_flags(args, &column);
+    if (flags < 0) {
+        editor_set_status_msg(ctx, "Usage: :[range]sort [n][r][u] [column]");
+        return 0;
+    }
+    if (column >= 0 && ctx->model.columns == NULL) {
+        editor_set_status_msg(ctx, "Sorting by a column needs :columns");
+        return 0;
+    }
+    if (first < 0 || first > last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "Invalid range");
+        return 0;
+    }
+    int rows = sort_lines(ctx, first, last, flags, column);
+    if (rows < 0) return 0;
+    int gone = last - first + 1 - rows;
+    if (gone > 0)
+        editor_set_status_msg(ctx, "%d lines sorted, %d fewer", rows, gone);
+    else
+        editor_set_status_msg(ctx, "%d line%s sorted", rows, rows > 1 ? "s" : "");
+    return 1;
+}
+
+/* :sort [n][r][u] [column] - The same over the whole buffer */
+int cmd_sort(editor_ctx_t *ctx, const char *args) {
+    if (ctx->model.numrows == 0) {
+        editor_set_status_msg(ctx, "Nothing to sort");
+        return 1;
+    }
+    return cmd_sort_range(ctx, 0, ctx->model.numrows - 1, args);
+}
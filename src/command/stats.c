@@ -0,0 +1,207 @@
+/* stats.c - Runtime statistics commands (:stats)
+ *
+ * :stats async lists, in a new buffer, where async event time goes: for
+ * each event type dispatched, how long its events waited from push to
+ * dispatch and how long its handler ran (see async_queue.h), and how
+ * many events were queued when dispatches began. :stats gc shows how the
+ * Lua collector's idle time schedule went (see lua_gc.h). :stats mem shows
+ * the memory of each subsystem (see memstats.h) and the row storage of the
+ * current buffer.
+ */
+
+#include "command_impl.h"
+#include "../async_queue.h"
+#include "../lua_gc.h"
+#include "../memstats.h"
+#include "../arena.h"
+
+/* Nanoseconds as a short duration */
+static const char *format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    else snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+    return buf;
+}
+
+/* Bytes as a short size */
+static const char *format_bytes(char *buf, size_t size, long long bytes) {
+    if (bytes < 0) bytes = 0;   /* Blocks from before accounting began */
+    if (bytes < 1024) snprintf(buf, size, "%lldB", bytes);
+    else if (bytes < 1024 * 1024) snprintf(buf, size, "%.1fK", (double)bytes / 1024);
+    else if (bytes < 1024LL * 1024 * 1024) snprintf(buf, size, "%.1fM", (double)bytes / (1024 * 1024));
+    else snprintf(buf, size, "%.2fG", (double)bytes / (1024 * 1024 * 1024));
+    return buf;
+}
+
+static void add_row(editor_ctx_t *ctx, char *text) {
+    editor_insert_row(ctx, ctx->model.numrows, text, strlen(text));
+}
+
+/* One row for a histogram of durations */
+static void add_timing_row(editor_ctx_t *ctx, const char *label,
+                           const AsyncHistStats *st) {
+    char p50[16], p90[16], p99[16], max[16], row[160];
+    snprintf(row, sizeof(row), "  %-8s p50 %-8s p90 %-8s p99 %-8s max %s", label,
+             format_ns(p50, sizeof(p50), st->p50), format_ns(p90, sizeof(p90), st->p90),
+             format_ns(p99, sizeof(p99), st->p99), format_ns(max, sizeof(max), st->max));
+    add_row(ctx, row);
+}
+
+/* :stats gc [reset] - Show the Lua collector's idle time schedule */
+static int stats_gc(editor_ctx_t *ctx, int reset) {
+    if (reset) {
+        lua_gc_reset_stats();
+        editor_set_status_msg(ctx, "stats: Lua collector statistics cleared");
+        return 1;
+    }
+
+    int id = buffer_create(NULL);
+    editor_ctx_t *out = id >= 0 ? buffer_get(id) : NULL;
+    if (!out) {
+        editor_set_status_msg(ctx, "stats: Can't open a buffer for the report");
+        return 0;
+    }
+    editor_del_row(out, 0);
+
+    LuaGcStats st;
+    lua_gc_get_stats(&st);
+    char total[16], mean[16], max[16], row[160];
+    size_t limit = lua_gc_get_burst_limit();
+    snprintf(row, sizeof(row), "Lua collector: %s mode, %zuk heap at the last idle run",
+             lua_gc_mode_name(lua_gc_get_mode()), st.heap_kb);
+    add_row(out, row);
+    snprintf(row, sizeof(row), "  idle     %llu runs, %llu steps, %llu cycles finished, "
+             "%.0fk allocated per run",
+             (unsigned long long)st.idle_runs, (unsigned long long)st.steps,
+             (unsigned long long)st.cycles, st.rate_kb);
+    add_row(out, row);
+    snprintf(row, sizeof(row), "  pauses   total %-8s mean %-8s max %s",
+             format_ns(total, sizeof(total), st.idle_ns),
+             format_ns(mean, sizeof(mean), st.idle_runs ? st.idle_ns / st.idle_runs : 0),
+             format_ns(max, sizeof(max), st.max_ns));
+    add_row(out, row);
+    if (limit) {
+        snprintf(row, sizeof(row), "  input    stopped for %llu bursts (%llu past %zuk), %s in all",
+                 (unsigned long long)st.bursts, (unsigned long long)st.overflows,
+                 limit / 1024, format_ns(total, sizeof(total), st.paused_ns));
+    } else {
+        snprintf(row, sizeof(row), "  input    not stopped (luagcburst=0)");
+    }
+    add_row(out, row);
+
+    out->model.dirty = 0;
+    buffer_switch(id);
+    return 1;
+}
+
+/* :stats mem - Show the memory of each subsystem and of the buffer's rows */
+static int stats_mem(editor_ctx_t *ctx) {
+    RowArena *arena = ctx->model.arena;
+    int numrows = ctx->model.numrows;
+    size_t rowcap = (size_t)ctx->model.rowcap;
+
+    int id = buffer_create(NULL);
+    editor_ctx_t *out = id >= 0 ? buffer_get(id) : NULL;
+    if (!out) {
+        editor_set_status_msg(ctx, "stats: Can't open a buffer for the report");
+        return 0;
+    }
+    editor_del_row(out, 0);
+
+    char row[160], live[16], peak[16];
+    if (memstats_enabled()) {
+        add_row(out, "Memory by subsystem:");
+        for (int tag = 0; tag < MEM_TAGS; tag++) {
+            MemTagStats st;
+            memstats_get((MemTag)tag, &st);
+            snprintf(row, sizeof(row), "  %-10s %-8s peak %-8s %llu allocs, %llu frees",
+                     memstats_tag_name((MemTag)tag),
+                     format_bytes(live, sizeof(live), st.bytes),
+                     format_bytes(peak, sizeof(peak), st.peak_bytes),
+                     (unsigned long long)st.allocs, (unsigned long long)st.frees);
+            add_row(out, row);
+        }
+    } else {
+        add_row(out, "Memory by subsystem: not counted (start with " MEMSTATS_ENV "=1)");
+    }
+
+    /* The buffer's rows, whether or not memory is counted */
+    ArenaStats as = {0};
+    if (arena) arena_get_stats(arena, &as);
+    size_t held = as.chunk_bytes + as.large_bytes + rowcap * sizeof(t_erow);
+    size_t used = as.used_bytes + as.large_bytes + (size_t)numrows * sizeof(t_erow);
+    snprintf(row, sizeof(row), "Buffer rows: %d, %s held (%s in use), %.1f bytes per line",
+             numrows, format_bytes(live, sizeof(live), (long long)held),
+             format_bytes(peak, sizeof(peak), (long long)used),
+             numrows ? (double)held / numrows : 0.0);
+    add_row(out, row);
+
+    out->model.dirty = 0;
+    buffer_switch(id);
+    return 1;
+}
+
+/* :stats async|gc|mem [reset] - Show async event or Lua collector timings,
+ * or memory, or clear the timings */
+int cmd_stats(editor_ctx_t *ctx, const char *args) {
+    const char *usage = "Usage: :stats async|gc [reset] | :stats mem";
+    if (args && strcmp(args, "mem") == 0) return stats_mem(ctx);
+    if (args && strncmp(args, "gc", 2) == 0 &&
+        (!args[2] || strcmp(args + 2, " reset") == 0))
+        return stats_gc(ctx, args[2] != '\0');
+    if (!args || strncmp(args, "async", 5) != 0 ||
+        (args[5] && strcmp(args + 5, " reset") != 0)) {
+        editor_set_status_msg(ctx, "%s", usage);
+        return 0;
+    }
+    if (!async_queue_global()) {
+        editor_set_status_msg(ctx, "stats: No event queue");
+        return 0;
+    }
+    if (args[5]) {
+        async_queue_reset_timing(NULL);
+        editor_set_status_msg(ctx, "stats: Async timings cleared");
+        return 1;
+    }
+
+    int id = buffer_create(NULL);
+    editor_ctx_t *out = id >= 0 ? buffer_get(id) : NULL;
+    if (!out) {
+        editor_set_status_msg(ctx, "stats: Can't open a buffer for the report");
+        return 0;
+    }
+    editor_del_row(out, 0);
+
+    AsyncHistStats depth, latency, handler;
+    async_queue_get_depth_stats(NULL, &depth);
+    char row[160];
+    snprintf(row, sizeof(row),
+             "async events: %d queued; at dispatch p50 %llu p99 %llu max %llu",
+             async_queue_count(NULL), (unsigned long long)depth.p50,
+             (unsigned long long)depth.p99, (unsigned long long)depth.max);
+    add_row(out, row);
+
+    int types = 0;
+    for (int type = ASYNC_EVENT_NONE + 1; type < ASYNC_EVENT_TYPE_COUNT; type++) {
+        if (async_queue_get_type_stats(NULL, (AsyncEventType)type, &latency, &handler) != 0)
+            continue;
+        char mean[16];
+        snprintf(row, sizeof(row), "%s (%d): %llu dispatched, waited %s on average",
+                 async_event_type_name((AsyncEventType)type), type,
+                 (unsigned long long)latency.count,
+                 format_ns(mean, sizeof(mean), latency.mean));
+        add_row(out, row);
+        add_timing_row(out, "waited", &latency);
+        if (handler.count) add_timing_row(out, "handler", &handler);
+        types++;
+    }
+    if (types == 0) {
+        snprintf(row, sizeof(row), "No events dispatched yet");
+        add_row(out, row);
+    }
+
+    out->model.dirty = 0;
+    buffer_switch(id);
+    return 1;
+}
@@ -1,127 +1,208 @@
 /* substitute.c - Search and replace command (:s/old/new/)
  *
- * Vim-style substitution on current line.
+ * Vim-style substitution on the current line or a range of lines (:%s,
+ * :N,Ms, :'<,'>s; see command_execute()). 'old' is a regex (see
+ * regexp.h); in 'new', & stands for the matched text, and \& \/ \\ for
+ * the characters themselves.
  */
 
 #include "command_impl.h"
+#include "../regexp.h"
+#include "../search.h"
+#include "../search_index.h"
+#include "../terminal.h"
+#include "../undo.h"
+
+const char *command_parse_delimited(const char *p, char delim, struct abuf *out) {
+    while (*p && *p != delim) {
+        if (*p == '\\' && p[1]) {
+            if (p[1] != delim) terminal_buffer_append(out, p, 1);
+            p++;
+        }
+        terminal_buffer_append(out, p++, 1);
+    }
+    return p;
+}
+
+/* Append 'repl' with '&' replaced by the match. 'repl' has its escapes. */
+static void append_replacement(struct abuf *out, const char *repl, int len,
+                               const char *match, int match_len) {
+    int i = 0;
+    while (i < len) {
+        int j = i;
+        while (j < len && repl[j] != '\\' && repl[j] != '&') j++;
+        if (j > i) terminal_buffer_append(out, repl + i, j - i);
+        if (j == len) break;
+        if (repl[j] == '\\' && j + 1 < len) {
+            terminal_buffer_append(out, repl + j + 1, 1);
+            i = j + 2;
+        } else if (repl[j] == '&') {
+            if (match_len) terminal_buffer_append(out, match, match_len);
+            i = j + 1;
+        } else {
+            terminal_buffer_append(out, repl + j, 1);   /* Trailing '\' */
+            i = j + 1;
+        }
+    }
+}
 
-/* :s/old/new/[g] - Search and replace on current line */
+/* The 'len' bytes at 'line' with the first match (every match if
+ * 'global') replaced go to 'out'. Returns the number of matches. */
+static int substitute_line(Regexp *re, const char *line, int len,
+                           const struct abuf *repl, int global,
+                           struct abuf *out) {
+    int count = 0;
+    int i = 0, start, end;
+    while (i <= len && regexp_search(re, line, len, i, &start, &end)) {
+        if (start > i) terminal_buffer_append(out, line + i, start - i);
+        append_replacement(out, repl->b, repl->len, line + start, end - start);
+        count++;
+        i = end;
+        if (end == start) {
+            /* An empty match: step over a character before the next one */
+            if (i < len) terminal_buffer_append(out, line + i, 1);
+            i++;
+        }
+        if (!global) break;
+    }
+    if (count && i < len) terminal_buffer_append(out, line + i, len - i);
+    return count;
+}
+
+/* :s/old/new/[gi] - Search and replace on current line */
 int cmd_substitute(editor_ctx_t *ctx, const char *pattern) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    return cmd_substitute_range(ctx, row, row, pattern);
+}
+
+/* Search and replace on rows first..last, only those in 'lines' unless
+ * it is NULL. Each changed row is rewritten once, and the whole command
+ * is one undo step. */
+static int substitute(editor_ctx_t *ctx, int first, int last,
+                      const SearchRanges *lines, const char *pattern) {
     if (!pattern || pattern[0] != 's' || pattern[1] != '/') {
-        editor_set_status_msg(ctx, "Usage: :s/old/new/[g]");
+        editor_set_status_msg(ctx, "Usage: :[range]s/old/new/[gi]");
         return 0;
     }
 
-    /* Parse s/old/new/[g] pattern */
-    const char *p = pattern + 2;  /* Skip "s/" */
+    /* Parse s/old/new/[gi] pattern */
+    struct abuf old_str = ABUF_INIT;
+    struct abuf new_str = ABUF_INIT;
+    struct abuf new_line = ABUF_INIT;
+    SearchRanges rows = {NULL, 0, 0};
+    undo_rows_t undo = {0};
+    Regexp *re = NULL;
+    int result = 0;
 
-    /* Find the "old" string (up to next unescaped /) */
-    char old_str[256] = {0};
-    int old_len = 0;
-    while (*p && *p != '/' && old_len < 255) {
-        if (*p == '\\' && *(p + 1)) {
-            /* Escaped character */
-            p++;
-            old_str[old_len++] = *p++;
-        } else {
-            old_str[old_len++] = *p++;
-        }
-    }
-    old_str[old_len] = '\0';
+    const char *p = command_parse_delimited(pattern + 2, '/', &old_str);  /* Skip "s/" */
+    terminal_buffer_append(&old_str, "", 1);
 
     if (*p != '/') {
         editor_set_status_msg(ctx, "Invalid substitute pattern");
-        return 0;
-    }
-    p++;  /* Skip middle '/' */
-
-    /* Find the "new" string (up to next unescaped / or end) */
-    char new_str[256] = {0};
-    int new_len = 0;
-    while (*p && *p != '/' && new_len < 255) {
-        if (*p == '\\' && *(p + 1)) {
-            /* Escaped character */
-            p++;
-            new_str[new_len++] = *p++;
-        } else {
-            new_str[new_len++] = *p++;
-        }
+        goto done;
     }
-    new_str[new_len] = '\0';
+    p = command_parse_delimited(p + 1, '/', &new_str);
 
-    /* Check for global flag */
-    int global = 0;
+    /* Check for flags: i and I ignore case or not, else :set ignorecase
+     * and smartcase decide */
+    int global = 0, icase = -1;
     if (*p == '/') {
         p++;
         while (*p) {
             if (*p == 'g') global = 1;
+            if (*p == 'i') icase = 1;
+            if (*p == 'I') icase = 0;
             p++;
         }
     }
+    if (icase < 0)
+        icase = search_ignores_case(ctx, old_str.b, old_str.len - 1, 1);
 
-    if (old_len == 0) {
+    if (old_str.b[0] == '\0') {
         editor_set_status_msg(ctx, "Empty search pattern");
-        return 0;
+        goto done;
     }
 
-    /* Perform substitution on current line */
-    if (ctx->view.cy >= ctx->model.numrows) {
-        editor_set_status_msg(ctx, "No line to substitute");
-        return 0;
+    const char *error;
+    re = regexp_compile(old_str.b, icase ? REGEXP_ICASE : 0, &error);
+    if (!re) {
+        editor_set_status_msg(ctx, "Invalid pattern: %s", error);
+        goto done;
     }
 
-    t_erow *row = &ctx->model.row[ctx->view.cy];
-    char *line = row->chars;
-    int line_len = row->size;
-
-    /* Build new line with substitutions */
-    char new_line[4096] = {0};
-    int new_line_len = 0;
-    int count = 0;
-    int i = 0;
+    if (ctx->model.numrows == 0 ||
+        (first == last && first >= ctx->model.numrows)) {
+        editor_set_status_msg(ctx, "No line to substitute");
+        goto done;
+    }
+    if (first < 0 || first > last || last >= ctx->model.numrows) {
+        editor_set_status_msg(ctx, "Invalid range");
+        goto done;
+    }
 
-    while (i < line_len && new_line_len < 4090) {
-        /* Check for match at current position */
-        if (i + old_len <= line_len && strncmp(line + i, old_str, old_len) == 0) {
-            /* Found a match - substitute */
-            if (new_line_len + new_len < 4090) {
-                memcpy(new_line + new_line_len, new_str, new_len);
-                new_line_len += new_len;
-                i += old_len;
-                count++;
-                if (!global) {
-                    /* Copy rest of line after first substitution */
-                    int remaining = line_len - i;
-                    if (new_line_len + remaining < 4096) {
-                        memcpy(new_line + new_line_len, line + i, remaining);
-                        new_line_len += remaining;
-                    }
-                    break;
+    /* Rows that can match (see search_index.h), within the range */
+    const char *lit;
+    int litlen = regexp_required(re, &lit);
+    search_index_lookup(&ctx->model, lit, litlen, &rows);
+
+    int count = 0, changed = 0, line = 0;
+    for (int i = search_ranges_find(&rows, first);
+         i < rows.n && rows.r[i].first <= last; i++) {
+        int from = rows.r[i].first > first ? rows.r[i].first : first;
+        int to = rows.r[i].last < last ? rows.r[i].last : last;
+        for (int r = from; r <= to; r++) {
+            if (lines) {
+                while (line < lines->n && lines->r[line].last < r) line++;
+                if (line == lines->n) break;
+                if (lines->r[line].first > r) {
+                    r = lines->r[line].first - 1;   /* Skip to the next */
+                    continue;
                 }
-            } else {
-                break;  /* Output buffer full */
             }
-        } else {
-            /* No match - copy character */
-            new_line[new_line_len++] = line[i++];
+            t_erow *row = &ctx->model.row[r];
+            new_line.len = 0;
+            int n = substitute_line(re, row->chars, row->size, &new_str,
+                                    global, &new_line);
+            if (n == 0) continue;
+            undo_rows_set(&undo, ctx, r, new_line.b, new_line.len);
+            count += n;
+            changed++;
         }
     }
-    new_line[new_line_len] = '\0';
 
     if (count == 0) {
-        editor_set_status_msg(ctx, "Pattern not found: %s", old_str);
-        return 0;
+        editor_set_status_msg(ctx, "Pattern not found: %s", old_str.b);
+        goto done;
     }
+    undo_record_replace_rows(ctx, &undo);
+
+    if (changed > 1)
+        editor_set_status_msg(ctx, "%d substitution%s on %d lines", count,
+                              count > 1 ? "s" : "", changed);
+    else
+        editor_set_status_msg(ctx, "%d substitution%s", count,
+                              count > 1 ? "s" : "");
+    result = 1;
+
+done:
+    regexp_free(re);
+    search_ranges_free(&rows);
+    undo_rows_free(&undo);
+    terminal_buffer_free(&old_str);
+    terminal_buffer_free(&new_str);
+    terminal_buffer_free(&new_line);
+    return result;
+}
 
-    /* Update the row */
-    free(row->chars);
-    row->chars = strdup(new_line);
-    row->size = new_line_len;
-
-    /* Update render */
-    editor_update_row(ctx, row);
+/* :N,Ms/old/new/[gi] - Search and replace on rows first..last */
+int cmd_substitute_range(editor_ctx_t *ctx, int first, int last,
+                         const char *pattern) {
+    return substitute(ctx, first, last, NULL, pattern);
+}
 
-    ctx->model.dirty++;
-    editor_set_status_msg(ctx, "%d substitution%s", count, count > 1 ? "s" : "");
-    return 1;
+/* :g/re/s/old/new/[gi] - Search and replace on the rows in 'lines' */
+int cmd_substitute_lines(editor_ctx_t *ctx, const SearchRanges *lines,
+                         const char *pattern) {
+    if (lines->n == 0) return 0;
+    return substitute(ctx, lines->r[0].first, lines->r[lines->n - 1].last, lines, pattern);
 }
@@ -0,0 +1,106 @@
+/* tag.c - Symbol index commands (:tag, :tag!)
+ *
+ * :tag name goes to the definition of name in the project's symbol index
+ * (symbols.h), opening its file; with several, :tag name again goes to
+ * the next. :tag alone says what the index holds. :tag! looks for files
+ * changed outside the editor. The project is the directory the editor
+ * runs in, and its index is opened on first use.
+ */
+
+#include "command_impl.h"
+#include "../symbols.h"
+#include <limits.h>
+#include <sys/stat.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Definitions of one name :tag goes through */
+#define TAG_MAX_MATCHES 64
+
+/* The name :tag went to last, and which of its definitions */
+static char tag_name[SYMBOLS_MAX_NAME + 1];
+static int tag_at;
+
+static int open_index(editor_ctx_t *ctx) {
+    if (symbols_root() == NULL && symbols_open(".") != 0) {
+        editor_set_status_msg(ctx, "Can't open the symbol index");
+        return -1;
+    }
+    return 0;
+}
+
+static int same_file(const char *a, const char *b) {
+    struct stat sa, sb;
+    return a && stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* :tag - What the index holds */
+static int show_index(editor_ctx_t *ctx) {
+    long files, symbols;
+    symbols_counts(&files, &symbols);
+    editor_set_status_msg(ctx, "Symbol index: %ld files, %ld symbols%s", files,
+                          symbols, symbols_busy() ? " (indexing...)" : "");
+    return 1;
+}
+
+/* :tag [name] - Go to the definition of 'name' (the next one, when asked
+ * again), or say what the index holds */
+int cmd_tag(editor_ctx_t *ctx, const char *args) {
+    if (open_index(ctx) != 0) return 0;
+    if (args == NULL || args[0] == '\0') return show_index(ctx);
+
+    Symbol found[TAG_MAX_MATCHES];
+    int n = symbols_find(args, 0, found, TAG_MAX_MATCHES);
+    if (n <= 0) {
+        if (symbols_busy())
+            editor_set_status_msg(ctx, "Indexing symbols... (no %s yet)", args);
+        else
+            editor_set_status_msg(ctx, "No definition of %s", args);
+        return 0;
+    }
+    int at = strcmp(tag_name, args) == 0 ? (tag_at + 1) % n : 0;
+    snprintf(tag_name, sizeof(tag_name), "%s", args);
+    tag_at = at;
+
+    const Symbol *s = &found[at];
+    const char *root = symbols_root();
+    char path[PATH_MAX];
+    if (strcmp(root, ".") == 0)
+        snprintf(path, sizeof(path), "%.*s", s->path_len, s->path);
+    else
+        snprintf(path, sizeof(path), "%s/%.*s", root, s->path_len, s->path);
+    int line = s->line;
+    const char *kind = symbols_kind_name(s->kind);
+
+    editor_ctx_t *target = ctx;
+    if (!same_file(ctx->model.filename, path)) {
+        int id = buffer_create(path);
+        if (id < 0) {
+            editor_set_status_msg(ctx, "Can't open \"%s\"", path);
+            return 0;
+        }
+        buffer_switch(id);
+        target = buffer_get(id);
+    }
+    char num[16];
+    snprintf(num, sizeof(num), "%d", line);
+    cmd_goto(target, num);
+    if (n > 1)
+        editor_set_status_msg(target, "%s %s: %d of %d (:tag %s for the next)",
+                              kind, args, at + 1, n, args);
+    else
+        editor_set_status_msg(target, "%s %s", kind, args);
+    return 1;
+}
+
+/* :tag! - Index the files changed outside the editor */
+int cmd_tag_refresh(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    if (open_index(ctx) != 0) return 0;
+    symbols_refresh();
+    editor_set_status_msg(ctx, "Indexing symbols under %s...", symbols_root());
+    return 1;
+}
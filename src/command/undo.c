@@ -0,0 +1,99 @@
+/* undo.c - Undo tree commands (:undo, :redo, :earlier, :later)
+ *
+ * The undo tree keeps every branch (see undo.h). :undo N goes to the
+ * state after group N, whatever branch it is on; :earlier and :later move
+ * through the states in the order they were made, by count or by time.
+ */
+
+#include "command_impl.h"
+#include "../undo.h"
+
+/* Say which state the buffer is now in, unless a group couldn't be read
+ * back (undo.c said so) */
+static void report_state(editor_ctx_t *ctx, int moved, const char *none) {
+    if (moved == -2) return;
+    if (!moved) {
+        editor_set_status_msg(ctx, "%s", none);
+        return;
+    }
+    int newest;
+    int seq = undo_state_seq(ctx, &newest);
+    editor_set_status_msg(ctx, "Undo state %d of %d", seq, newest);
+}
+
+/* :undo [N] - Undo one group, or go to the state after group N */
+int cmd_undo(editor_ctx_t *ctx, const char *args) {
+    if (!args || !args[0]) {
+        report_state(ctx, undo_perform(ctx), "Already at oldest change");
+        return 1;
+    }
+
+    char *end;
+    long seq = strtol(args, &end, 10);
+    if (end == args || *end || seq < 0) {
+        editor_set_status_msg(ctx, "Usage: :undo [N]");
+        return 0;
+    }
+    int moved = undo_goto(ctx, (int)seq);
+    if (moved == -1) {
+        editor_set_status_msg(ctx, "undo: State %ld is not kept", seq);
+        return 0;
+    }
+    if (moved == -2) return 0;
+    report_state(ctx, 1, "");
+    return 1;
+}
+
+/* :redo - Redo the group last undone */
+int cmd_redo(editor_ctx_t *ctx, const char *args) {
+    (void)args;
+    report_state(ctx, redo_perform(ctx), "Already at newest change");
+    return 1;
+}
+
+/* Move 'dir' (-1 earlier, 1 later) by "N" states, or "Ns", "Nm", "Nh" or
+ * "Nd" in time */
+static int move_in_time(editor_ctx_t *ctx, const char *args, int dir) {
+    const char *usage = dir < 0 ? "Usage: :earlier [N | N{s,m,h,d}]"
+                                : "Usage: :later [N | N{s,m,h,d}]";
+    long count = 1;
+    char unit = '\0';
+    if (args && args[0]) {
+        char *end;
+        count = strtol(args, &end, 10);
+        if (end == args || count < 0 || (end[0] && end[1])) {
+            editor_set_status_msg(ctx, "%s", usage);
+            return 0;
+        }
+        unit = end[0];
+    }
+
+    int moved;
+    if (unit == '\0') {
+        moved = undo_step(ctx, dir * (int)count);
+    } else {
+        long secs = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600
+                  : unit == 'd' ? 86400 : 0;
+        if (secs == 0) {
+            editor_set_status_msg(ctx, "%s", usage);
+            return 0;
+        }
+        time_t when = undo_state_time(ctx) + dir * (time_t)(count * secs);
+        /* Later than the newest state is the newest */
+        if (dir > 0 && undo_state_time(ctx) == 0) when = time(NULL);
+        moved = undo_goto_time(ctx, when);
+    }
+    report_state(ctx, moved, dir < 0 ? "Already at oldest change"
+                                     : "Already at newest change");
+    return 1;
+}
+
+/* :earlier [N | N{s,m,h,d}] - Go back N states, or in time */
+int cmd_earlier(editor_ctx_t *ctx, const char *args) {
+    return move_in_time(ctx, args, -1);
+}
+
+/* :later [N | N{s,m,h,d}] - Go forward N states, or in time */
+int cmd_later(editor_ctx_t *ctx, const char *args) {
+    return move_in_time(ctx, args, 1);
+}
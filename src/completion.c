@@ -0,0 +1,392 @@
+/* completion.c - An index of words to complete from
+ *
+ * The words are an array of entries kept sorted by strcmp(); words new to
+ * a source being synced wait in 'pending' and are sorted and merged in
+ * when the sync ends, so bringing thousands in costs one merge, not an
+ * insertion each.
+ */
+
+#include "completion.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Entry {
+    uint64_t mask;          /* Characters in the word (char_bit()) */
+    unsigned sources;       /* Sources holding it, a bit each */
+    unsigned synced;        /* Sources that added it again in their sync */
+    size_t len;
+    char word[];
+} Entry;
+
+struct CompletionIndex {
+    Entry **words;          /* Sorted */
+    int count, cap;
+    Entry **pending;        /* New to the index during a sync */
+    int npending, pending_cap;
+    unsigned syncing;       /* Sources in a sync */
+};
+
+typedef struct {
+    const Entry *entry;
+    int score;
+} Candidate;
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+static int fold(int c) {
+    return tolower((unsigned char)c);
+}
+
+/* One of 64 bits for a character, case folded: letters and digits have
+ * their own, the rest share */
+static uint64_t char_bit(int c) {
+    c = fold(c);
+    if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+    if (c == '_') return 1ULL << 36;
+    if (c == '.') return 1ULL << 37;
+    return 1ULL << (38 + (unsigned char)c % 26);
+}
+
+static uint64_t chars_mask(const char *s, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) mask |= char_bit(s[i]);
+    return mask;
+}
+
+static int is_word_char(int c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static Entry *entry_new(const char *word, size_t len, unsigned bit) {
+    Entry *e = malloc(sizeof(Entry) + len + 1);
+    if (!e) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(e->word, word, len);
+    e->word[len] = '\0';
+    e->len = len;
+    e->mask = chars_mask(word, len);
+    e->sources = bit;
+    e->synced = 0;
+    return e;
+}
+
+/* Compare the 'len' bytes at 'word' with an entry's word, as strcmp() */
+static int word_cmp(const char *word, size_t len, const Entry *e) {
+    size_t n = len < e->len ? len : e->len;
+    int c = memcmp(word, e->word, n);
+    if (c) return c;
+    return len < e->len ? -1 : len > e->len;
+}
+
+/* Position of the first word not less than 'word' */
+static int lower_bound(const CompletionIndex *ix, const char *word, size_t len) {
+    int lo = 0, hi = ix->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (word_cmp(word, len, ix->words[mid]) > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Position of the first word past those starting with 'prefix' */
+static int prefix_end(const CompletionIndex *ix, int from, const char *prefix, size_t len) {
+    int lo = from, hi = ix->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const Entry *e = ix->words[mid];
+        if (e->len >= len && memcmp(e->word, prefix, len) == 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int find(const CompletionIndex *ix, const char *word, size_t len) {
+    int i = lower_bound(ix, word, len);
+    return i < ix->count && word_cmp(word, len, ix->words[i]) == 0 ? i : -1;
+}
+
+static int valid_source(int source) {
+    return source >= 0 && source < 32;
+}
+
+CompletionIndex *completion_index_new(void) {
+    CompletionIndex *ix = calloc(1, sizeof(*ix));
+    if (!ix) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return ix;
+}
+
+void completion_index_free(CompletionIndex *ix) {
+    if (!ix) return;
+    for (int i = 0; i < ix->count; i++) free(ix->words[i]);
+    for (int i = 0; i < ix->npending; i++) free(ix->pending[i]);
+    free(ix->words);
+    free(ix->pending);
+    free(ix);
+}
+
+int completion_index_count(const CompletionIndex *ix) {
+    return ix ? ix->count : 0;
+}
+
+void completion_index_add(CompletionIndex *ix, const char *word, size_t len, int source) {
+    if (!ix || !word || len == 0 || len > COMPLETION_WORD_MAX || !valid_source(source)) return;
+    if (memchr(word, '\0', len)) return;
+    unsigned bit = 1u << source;
+
+    int i = find(ix, word, len);
+    if (i >= 0) {
+        ix->words[i]->sources |= bit;
+        if (ix->syncing & bit) ix->words[i]->synced |= bit;
+        return;
+    }
+
+    Entry *e = entry_new(word, len, bit);
+    if (ix->syncing & bit) {
+        e->synced = bit;
+        if (ix->npending == ix->pending_cap) {
+            ix->pending_cap = ix->pending_cap ? ix->pending_cap * 2 : 64;
+            ix->pending = xrealloc(ix->pending, sizeof(Entry *) * (size_t)ix->pending_cap);
+        }
+        ix->pending[ix->npending++] = e;
+        return;
+    }
+
+    if (ix->count == ix->cap) {
+        ix->cap = ix->cap ? ix->cap * 2 : 64;
+        ix->words = xrealloc(ix->words, sizeof(Entry *) * (size_t)ix->cap);
+    }
+    i = lower_bound(ix, word, len);
+    memmove(ix->words + i + 1, ix->words + i, sizeof(Entry *) * (size_t)(ix->count - i));
+    ix->words[i] = e;
+    ix->count++;
+}
+
+void completion_index_remove(CompletionIndex *ix, const char *word, size_t len, int source) {
+    if (!ix || !word || !valid_source(source)) return;
+    int i = find(ix, word, len);
+    if (i < 0) return;
+    Entry *e = ix->words[i];
+    e->sources &= ~(1u << source);
+    e->synced &= ~(1u << source);
+    if (e->sources) return;
+    free(e);
+    memmove(ix->words + i, ix->words + i + 1, sizeof(Entry *) * (size_t)(ix->count - i - 1));
+    ix->count--;
+}
+
+void completion_index_begin(CompletionIndex *ix, int source) {
+    if (!ix || !valid_source(source)) return;
+    ix->syncing |= 1u << source;
+}
+
+static int pending_cmp(const void *a, const void *b) {
+    const Entry *x = *(const Entry *const *)a, *y = *(const Entry *const *)b;
+    return word_cmp(x->word, x->len, y);
+}
+
+void completion_index_end(CompletionIndex *ix, int source) {
+    if (!ix || !valid_source(source)) return;
+    unsigned bit = 1u << source;
+    if (!(ix->syncing & bit)) return;
+    ix->syncing &= ~bit;
+
+    /* The new words, sorted, each once */
+    int npending = 0;
+    if (ix->npending > 0) {
+        qsort(ix->pending, (size_t)ix->npending, sizeof(Entry *), pending_cmp);
+        for (int i = 0; i < ix->npending; i++) {
+            if (npending > 0 && pending_cmp(&ix->pending[npending - 1], &ix->pending[i]) == 0) {
+                ix->pending[npending - 1]->sources |= ix->pending[i]->sources;
+                ix->pending[npending - 1]->synced |= ix->pending[i]->synced;
+                free(ix->pending[i]);
+                continue;
+            }
+            ix->pending[npending++] = ix->pending[i];
+        }
+    }
+    ix->npending = 0;
+
+    int total = ix->count + npending;
+    Entry **out = ix->words;
+    if (npending > 0) {
+        if (total > ix->cap) ix->cap = total;
+        out = malloc(sizeof(Entry *) * (size_t)ix->cap);
+        if (!out) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+
+    /* Merge, dropping what the source held but did not add again (in
+     * place, without new words, as the output never overtakes the input) */
+    int i = 0, j = 0, n = 0;
+    while (i < ix->count || j < npending) {
+        Entry *e;
+        if (j >= npending) e = ix->words[i++];
+        else if (i >= ix->count) e = ix->pending[j++];
+        else {
+            int c = pending_cmp(&ix->words[i], &ix->pending[j]);
+            if (c < 0) e = ix->words[i++];
+            else if (c > 0) e = ix->pending[j++];
+            else {
+                /* Added by another source meanwhile */
+                e = ix->words[i++];
+                e->sources |= bit;
+                e->synced |= bit;
+                free(ix->pending[j++]);
+            }
+        }
+        if ((e->sources & bit) && !(e->synced & bit)) {
+            e->sources &= ~bit;
+            if (!e->sources) {
+                free(e);
+                continue;
+            }
+        }
+        e->synced &= ~bit;
+        out[n++] = e;
+    }
+    if (out != ix->words) {
+        free(ix->words);
+        ix->words = out;
+    }
+    ix->count = n;
+}
+
+void completion_index_add_text(CompletionIndex *ix, const char *text, size_t len,
+                               int source, size_t min_len) {
+    size_t i = 0;
+    while (i < len) {
+        if (!is_word_char(text[i])) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < len && is_word_char(text[i])) i++;
+        if (isdigit((unsigned char)text[start])) continue;
+        if (i - start >= min_len) completion_index_add(ix, text + start, i - start, source);
+    }
+}
+
+int completion_index_prefix(const CompletionIndex *ix, const char *prefix, size_t len,
+                            int *first, size_t *common) {
+    if (first) *first = 0;
+    if (common) *common = len;
+    if (!ix || ix->count == 0) return 0;
+
+    int lo = lower_bound(ix, prefix, len);
+    int hi = prefix_end(ix, lo, prefix, len);
+    if (first) *first = lo;
+    if (hi > lo && common) {
+        /* Sorted, so what the first and last share, all do */
+        const Entry *a = ix->words[lo], *b = ix->words[hi - 1];
+        size_t n = len;
+        while (n < a->len && n < b->len && a->word[n] == b->word[n]) n++;
+        *common = n;
+    }
+    return hi - lo;
+}
+
+const char *completion_index_word(const CompletionIndex *ix, int i) {
+    if (!ix || i < 0 || i >= ix->count) return NULL;
+    return ix->words[i]->word;
+}
+
+/* Keep the 'max' best scored (the earlier of two the same) in 'best' */
+static void keep(Candidate *best, int *n, int max, const Entry *e, int score) {
+    int i = *n;
+    if (i == max) {
+        if (score <= best[max - 1].score) return;
+        i--;
+    } else {
+        (*n)++;
+    }
+    while (i > 0 && best[i - 1].score < score) {
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i].entry = e;
+    best[i].score = score;
+}
+
+/* Whether a part of the word starts at 'i': after a non-word character,
+ * or an upper case letter after a lower case one */
+static int starts_part(const char *w, size_t i) {
+    if (i == 0) return 1;
+    if (!isalnum((unsigned char)w[i - 1])) return 1;
+    return isupper((unsigned char)w[i]) && islower((unsigned char)w[i - 1]);
+}
+
+/* Score 'query' as a subsequence of the word (case folded), or -1 if it
+ * is not one: characters running on from the last matched, and those
+ * starting a part of the word, count most; shorter words win ties */
+static int fuzzy_score(const Entry *e, const char *query, size_t qlen) {
+    int score = 0;
+    size_t q = 0, last = 0;
+    for (size_t i = 0; i < e->len && q < qlen; i++) {
+        if (fold(e->word[i]) != fold(query[q])) continue;
+        int s = 1;
+        if (q > 0 && last + 1 == i) s += 4;
+        if (starts_part(e->word, i)) s += 3;
+        score += s;
+        last = i;
+        q++;
+    }
+    if (q < qlen) return -1;
+    return score * 256 - (int)e->len;
+}
+
+int completion_index_query(const CompletionIndex *ix, const char *query, size_t len,
+                           const char **out, int max) {
+    if (!ix || max <= 0 || ix->count == 0) return 0;
+    Candidate *best = malloc(sizeof(Candidate) * (size_t)max);
+    if (!best) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    int first;
+    int nprefix = completion_index_prefix(ix, query, len, &first, NULL);
+    int n = 0;
+    for (int i = first; i < first + nprefix; i++)
+        keep(best, &n, max, ix->words[i], -(int)ix->words[i]->len);
+
+    /* Fuzzy matches after them, in the room left */
+    int nfuzzy = 0;
+    if (n < max && len >= 2) {
+        uint64_t need = chars_mask(query, len);
+        Candidate *fuzzy = best + n;
+        int room = max - n;
+        for (int i = 0; i < ix->count; i++) {
+            if (nprefix > 0 && i == first) {
+                i += nprefix - 1;
+                continue;
+            }
+            const Entry *e = ix->words[i];
+            if ((e->mask & need) != need || e->len < len) continue;
+            int score = fuzzy_score(e, query, len);
+            if (score >= 0) keep(fuzzy, &nfuzzy, room, e, score);
+        }
+    }
+
+    for (int i = 0; i < n + nfuzzy; i++) out[i] = best[i].entry->word;
+    free(best);
+    return n + nfuzzy;
+}
@@ -0,0 +1,81 @@
+/* completion.h - An index of words to complete from
+ *
+ * The REPLs and the Lua console complete the word before the cursor from
+ * a CompletionIndex: the candidates are kept once, sorted, so the words
+ * with a prefix are one run of the index, found by binary search, and the
+ * longest prefix they share is that of the first and last of the run.
+ * A query ranks those prefix matches (shortest first), then, with room
+ * left, fuzzy ones: words holding the query's characters in order, scored
+ * by how many run on from each other or start a part of the word
+ * ("str.fmt" finds "string.format"). Each word keeps a mask of the
+ * characters in it, so a fuzzy query only scores the words that can
+ * match; tens of thousands of words are ranked in well under a
+ * millisecond.
+ *
+ * Words come from sources (COMPLETION_SOURCE_*). A source is updated in
+ * place by a sync: completion_index_begin(), its words added again, and
+ * completion_index_end(), which drops the words not added since; words
+ * new to the index are sorted in together at the end, so a sync costs
+ * the words it is given, plus one merge when some are new. A word held by
+ * several sources stays until the last lets go.
+ */
+
+#ifndef LOKI_COMPLETION_H
+#define LOKI_COMPLETION_H
+
+#include <stddef.h>
+
+/* Sources of words (at most 32) */
+enum {
+    COMPLETION_SOURCE_WORDS = 0,    /* A word list given by the caller */
+    COMPLETION_SOURCE_LUA,          /* Lua globals, and the fields of tables among them */
+    COMPLETION_SOURCE_LOKI,         /* The loki.* bindings */
+    COMPLETION_SOURCE_BUFFER        /* Words of the buffer being edited */
+};
+
+/* Longest word indexed */
+#define COMPLETION_WORD_MAX 255
+
+typedef struct CompletionIndex CompletionIndex;
+
+CompletionIndex *completion_index_new(void);
+void completion_index_free(CompletionIndex *ix);
+
+/* Words in the index */
+int completion_index_count(const CompletionIndex *ix);
+
+/* Add the 'len' bytes at 'word' from 'source' (longer words than
+ * COMPLETION_WORD_MAX, and empty ones, are not indexed). Between begin
+ * and end of a sync of a source, a word new to the index is held until
+ * the end. */
+void completion_index_add(CompletionIndex *ix, const char *word, size_t len, int source);
+
+/* Drop 'word' from 'source'; the word goes once no source holds it */
+void completion_index_remove(CompletionIndex *ix, const char *word, size_t len, int source);
+
+/* Start and finish a sync of 'source' (see above) */
+void completion_index_begin(CompletionIndex *ix, int source);
+void completion_index_end(CompletionIndex *ix, int source);
+
+/* Add the words of the 'len' bytes at 'text': runs of letters, digits
+ * and '_' (not starting with a digit) of 'min_len' bytes or more */
+void completion_index_add_text(CompletionIndex *ix, const char *text, size_t len,
+                               int source, size_t min_len);
+
+/* The words starting with 'prefix': returns how many there are, and the
+ * position of the first in *first (for completion_index_word()), and the
+ * bytes they all start with in *common (the prefix at least) */
+int completion_index_prefix(const CompletionIndex *ix, const char *prefix, size_t len,
+                            int *first, size_t *common);
+
+/* The word at position 'i' (0 .. count-1, in sorted order). Valid until
+ * the index next changes. */
+const char *completion_index_word(const CompletionIndex *ix, int i);
+
+/* Up to 'max' words for 'query', best first, in 'out' (valid until the
+ * index next changes): prefix matches, shortest first, then fuzzy ones
+ * (for queries of two bytes or more), best scored first. Returns how many. */
+int completion_index_query(const CompletionIndex *ix, const char *query, size_t len,
+                           const char **out, int max);
+
+#endif /* LOKI_COMPLETION_H */
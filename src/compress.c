@@ -0,0 +1,531 @@
+/* compress.c - Reading and writing gzip and zstd files
+ *
+ * See compress.h for an overview. A parallel decompression first lists the
+ * parts (CompressPart) and where their output goes, then has workers take
+ * them in turn from a shared counter.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LOKI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef LOKI_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "task_pool.h"
+
+/* Bytes given zlib per call, whose counts are 32-bit */
+#define ZLIB_STEP ((size_t)1 << 30)
+
+CompressFormat compress_detect(const void *data, size_t size) {
+    const unsigned char *p = data;
+    if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) return COMPRESS_GZIP;
+    if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+        return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t len = strlen(s), n = strlen(suffix);
+    return len > n && strcmp(s + len - n, suffix) == 0;
+}
+
+CompressFormat compress_format_for_path(const char *path) {
+    if (ends_with(path, ".gz") || ends_with(path, ".bgz")) return COMPRESS_GZIP;
+    if (ends_with(path, ".zst")) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+int compress_supported(CompressFormat format) {
+    switch (format) {
+    case COMPRESS_NONE: return 1;
+#ifdef LOKI_HAVE_ZLIB
+    case COMPRESS_GZIP: return 1;
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    case COMPRESS_ZSTD: return 1;
+#endif
+    default: return 0;
+    }
+}
+
+static uint32_t le16(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return le16(p) | le16(p + 2) << 16;
+}
+
+/* Room for at least 'need' bytes in *buf, doubling */
+static int grow(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : 4096;
+    while (n < need) n *= 2;
+    char *p = realloc(*buf, n);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+/* ======================== Parallel decompression ========================= */
+
+typedef struct CompressPart {
+    size_t in, in_len;          /* Its compressed bytes */
+    size_t out, out_len;        /* Where its output goes, and how long */
+    uint32_t crc;               /* BGZF: the output's CRC-32 */
+} CompressPart;
+
+typedef struct {
+    CompressFormat format;
+    const unsigned char *in;
+    char *out;
+    const CompressPart *parts;
+    int nparts;
+    atomic_int next;            /* The next part to take */
+    atomic_int failed;
+} InflateJob;
+
+static int inflate_part(const InflateJob *job, const CompressPart *part) {
+    const unsigned char *in = job->in + part->in;
+    char *out = job->out + part->out;
+#ifdef LOKI_HAVE_ZLIB
+    if (job->format == COMPRESS_GZIP) {
+        /* A raw deflate stream, the member's header and trailer aside. The
+         * last block of a file is an empty one. */
+        if (part->out_len == 0) return 0;
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK) return -1;
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = (uInt)part->in_len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)part->out_len;
+        int ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END || zs.avail_out != 0) return -1;
+        return crc32(0, (const Bytef *)out, (uInt)part->out_len) == part->crc ? 0 : -1;
+    }
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    if (job->format == COMPRESS_ZSTD) {
+        size_t n = ZSTD_decompress(out, part->out_len, in, part->in_len);
+        return !ZSTD_isError(n) && n == part->out_len ? 0 : -1;
+    }
+#endif
+    (void)in;
+    (void)out;
+    return -1;
+}
+
+static void inflate_worker(void *arg) {
+    InflateJob *job = arg;
+    int i;
+    while (!atomic_load(&job->failed) &&
+           (i = atomic_fetch_add(&job->next, 1)) < job->nparts) {
+        if (inflate_part(job, &job->parts[i]) == -1) atomic_store(&job->failed, 1);
+    }
+}
+
+/* Decompress the parts into a buffer of 'total' bytes */
+static int inflate_parts(CompressFormat format, const unsigned char *in,
+                         const CompressPart *parts, int nparts, size_t total,
+                         char **out, size_t *out_len) {
+    InflateJob job;
+    job.format = format;
+    job.in = in;
+    job.out = malloc(total ? total : 1);
+    job.parts = parts;
+    job.nparts = nparts;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    if (!job.out) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int nworkers = task_pool_threads();
+    if (nworkers > nparts) nworkers = nparts;
+    if (nworkers > COMPRESS_MAX_WORKERS) nworkers = COMPRESS_MAX_WORKERS;
+
+    /* The calling thread works too, so submit one fewer helper. */
+    Task *tasks[COMPRESS_MAX_WORKERS];
+    int started = 0;
+    while (started < nworkers - 1 &&
+           (tasks[started] = task_submit(inflate_worker, &job, TASK_PRIORITY_HIGH, NULL))) {
+        started++;
+    }
+    inflate_worker(&job);
+    for (int i = 0; i < started; i++) task_wait(tasks[i]);
+
+    if (atomic_load(&job.failed)) {
+        free(job.out);
+        errno = EINVAL;
+        return -1;
+    }
+    *out = job.out;
+    *out_len = total;
+    return 0;
+}
+
+/* Append a part to *parts. Returns -1 out of memory. */
+static int add_part(CompressPart **parts, int *n, int *cap, const CompressPart *part) {
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        CompressPart *p = realloc(*parts, sizeof(CompressPart) * (size_t)ncap);
+        if (!p) return -1;
+        *parts = p;
+        *cap = ncap;
+    }
+    (*parts)[(*n)++] = *part;
+    return 0;
+}
+
+/* ================================ gzip =================================== */
+
+#ifdef LOKI_HAVE_ZLIB
+/* The BGZF blocks of the file, if it is made of them (gzip members with
+ * a "BC" extra field giving their length). Returns the count, or 0. */
+static int bgzf_parts(const unsigned char *p, size_t size, CompressPart **parts,
+                      size_t *total) {
+    int n = 0, cap = 0;
+    size_t off = 0;
+    *parts = NULL;
+    *total = 0;
+    while (off < size) {
+        if (size - off < 18 || p[off] != 0x1f || p[off + 1] != 0x8b ||
+            p[off + 2] != 8 || !(p[off + 3] & 4))
+            goto not_bgzf;
+        size_t xlen = le16(p + off + 10), bsize = 0;
+        if (size - off < 12 + xlen) goto not_bgzf;
+        for (size_t x = off + 12; x + 4 <= off + 12 + xlen; x += 4 + le16(p + x + 2)) {
+            if (p[x] == 'B' && p[x + 1] == 'C' && le16(p + x + 2) == 2 &&
+                x + 6 <= off + 12 + xlen)
+                bsize = le16(p + x + 4) + (size_t)1;
+        }
+        if (bsize < 12 + xlen + 8 || bsize > size - off) goto not_bgzf;
+
+        CompressPart part;
+        part.in = off + 12 + xlen;
+        part.in_len = bsize - 12 - xlen - 8;
+        part.crc = le32(p + off + bsize - 8);
+        part.out = *total;
+        part.out_len = le32(p + off + bsize - 4);
+        if (add_part(parts, &n, &cap, &part) == -1) goto not_bgzf;
+        *total += part.out_len;
+        off += bsize;
+    }
+    return n;
+
+not_bgzf:
+    free(*parts);
+    *parts = NULL;
+    return 0;
+}
+
+/* Any gzip file, one member after another */
+static int gunzip_serial(const unsigned char *in, size_t size, char **out, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *buf = NULL;
+    size_t cap = 0, len = 0;
+    const unsigned char *end = in + size;
+    int ret = Z_OK;
+    zs.next_in = (Bytef *)in;
+
+    for (;;) {
+        if (zs.avail_in == 0 && zs.next_in < end) {
+            size_t left = (size_t)(end - zs.next_in);
+            zs.avail_in = (uInt)(left < ZLIB_STEP ? left : ZLIB_STEP);
+        }
+        if (grow(&buf, &cap, len + 1) == -1) break;
+        size_t room = cap - len < ZLIB_STEP ? cap - len : ZLIB_STEP;
+        zs.next_out = (Bytef *)buf + len;
+        zs.avail_out = (uInt)room;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        len += room - zs.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            /* Another member follows, or the end (trailing zeros aside) */
+            if (zs.avail_in == 0 && zs.next_in == end) break;
+            if ((size_t)(end - zs.next_in) < 2 || zs.next_in[0] != 0x1f ||
+                zs.next_in[1] != 0x8b)
+                break;
+            inflateReset(&zs);
+            ret = Z_OK;
+        } else if (ret == Z_BUF_ERROR && zs.avail_out != 0) {
+            break;          /* Cut short */
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(buf);
+        if (errno != ENOMEM) errno = EINVAL;
+        return -1;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+static int gunzip(const unsigned char *in, size_t size, char **out, size_t *out_len) {
+    CompressPart *parts;
+    size_t total;
+    int n = bgzf_parts(in, size, &parts, &total);
+    if (n >= COMPRESS_PARALLEL_MIN_PARTS) {
+        int ret = inflate_parts(COMPRESS_GZIP, in, parts, n, total, out, out_len);
+        free(parts);
+        return ret;
+    }
+    free(parts);
+    return gunzip_serial(in, size, out, out_len);
+}
+#endif
+
+/* ================================ zstd =================================== */
+
+#ifdef LOKI_HAVE_ZSTD
+/* The frames of the file, if every one gives its content size. Returns the
+ * count, or 0. */
+static int zstd_parts(const unsigned char *p, size_t size, CompressPart **parts,
+                      size_t *total) {
+    int n = 0, cap = 0;
+    size_t off = 0;
+    *parts = NULL;
+    *total = 0;
+    while (off < size) {
+        size_t len = ZSTD_findFrameCompressedSize(p + off, size - off);
+        if (ZSTD_isError(len)) goto unsized;
+        unsigned long long content = ZSTD_getFrameContentSize(p + off, len);
+        if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR)
+            goto unsized;
+
+        CompressPart part = {off, len, *total, (size_t)content, 0};
+        if (add_part(parts, &n, &cap, &part) == -1) goto unsized;
+        *total += (size_t)content;
+        off += len;
+    }
+    return n;
+
+unsized:
+    free(*parts);
+    *parts = NULL;
+    return 0;
+}
+
+static int unzstd_serial(const unsigned char *in, size_t size, char **out, size_t *out_len) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *buf = NULL;
+    size_t cap = 0, len = 0, ret = 1;
+    ZSTD_inBuffer src = {in, size, 0};
+    while (src.pos < src.size || ret != 0) {
+        if (grow(&buf, &cap, len + ZSTD_DStreamOutSize()) == -1) break;
+        ZSTD_outBuffer dst = {buf + len, cap - len, 0};
+        size_t before = src.pos;
+        ret = ZSTD_decompressStream(dctx, &dst, &src);
+        len += dst.pos;
+        if (ZSTD_isError(ret)) break;
+        /* Nothing more to read and nothing more came: cut short */
+        if (src.pos == src.size && src.pos == before && dst.pos == 0 && ret != 0) break;
+    }
+    ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(ret) || ret != 0) {
+        free(buf);
+        if (errno != ENOMEM) errno = EINVAL;
+        return -1;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+static int unzstd(const unsigned char *in, size_t size, char **out, size_t *out_len) {
+    CompressPart *parts;
+    size_t total;
+    int n = zstd_parts(in, size, &parts, &total);
+    if (n >= COMPRESS_PARALLEL_MIN_PARTS) {
+        int ret = inflate_parts(COMPRESS_ZSTD, in, parts, n, total, out, out_len);
+        free(parts);
+        return ret;
+    }
+    free(parts);
+    return unzstd_serial(in, size, out, out_len);
+}
+#endif
+
+int compress_inflate(CompressFormat format, const void *data, size_t size,
+                     char **out, size_t *out_len) {
+    errno = 0;
+#ifdef LOKI_HAVE_ZLIB
+    if (format == COMPRESS_GZIP) return gunzip(data, size, out, out_len);
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    if (format == COMPRESS_ZSTD) return unzstd(data, size, out, out_len);
+#endif
+    (void)data;
+    (void)size;
+    (void)out;
+    (void)out_len;
+    errno = format == COMPRESS_NONE ? EINVAL : ENOTSUP;
+    return -1;
+}
+
+/* ================================ Writing ================================ */
+
+struct CompressWriter {
+    CompressFormat format;
+    int fd;
+    long long written;
+    char out[COMPRESS_OUT_BYTES];
+#ifdef LOKI_HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+};
+
+static int write_all(CompressWriter *w, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(w->fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+        w->written += n;
+    }
+    return 0;
+}
+
+CompressWriter *compress_writer_open(CompressFormat format, int fd) {
+    if (format == COMPRESS_NONE || !compress_supported(format)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    CompressWriter *w = calloc(1, sizeof(*w));
+    if (!w) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->format = format;
+    w->fd = fd;
+#ifdef LOKI_HAVE_ZLIB
+    if (format == COMPRESS_GZIP &&
+        deflateInit2(&w->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(w);
+        errno = ENOMEM;
+        return NULL;
+    }
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    if (format == COMPRESS_ZSTD) {
+        w->cctx = ZSTD_createCCtx();
+        if (!w->cctx) {
+            free(w);
+            errno = ENOMEM;
+            return NULL;
+        }
+        /* Compress on threads of zstd's own, where it was built with them
+         * (refused otherwise, and compressed here) */
+        ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_nbWorkers, task_pool_threads());
+        ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_checksumFlag, 1);
+    }
+#endif
+    return w;
+}
+
+/* Compress the 'len' bytes at 'data', all the rest of it if 'finish' */
+static int writer_run(CompressWriter *w, const char *data, size_t len, int finish) {
+#ifdef LOKI_HAVE_ZLIB
+    if (w->format == COMPRESS_GZIP) {
+        for (;;) {
+            size_t step = len < ZLIB_STEP ? len : ZLIB_STEP;
+            int last = finish && step == len;
+            w->zs.next_in = (Bytef *)data;
+            w->zs.avail_in = (uInt)step;
+            int ret;
+            do {
+                w->zs.next_out = (Bytef *)w->out;
+                w->zs.avail_out = (uInt)sizeof(w->out);
+                ret = deflate(&w->zs, last ? Z_FINISH : Z_NO_FLUSH);
+                if (ret == Z_STREAM_ERROR) {
+                    errno = EIO;
+                    return -1;
+                }
+                if (write_all(w, w->out, sizeof(w->out) - w->zs.avail_out) == -1) return -1;
+            } while (w->zs.avail_out == 0 || (last && ret != Z_STREAM_END));
+            data += step;
+            len -= step;
+            if (len == 0) return 0;
+        }
+    }
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    if (w->format == COMPRESS_ZSTD) {
+        ZSTD_inBuffer src = {data, len, 0};
+        size_t left;
+        do {
+            ZSTD_outBuffer dst = {w->out, sizeof(w->out), 0};
+            left = ZSTD_compressStream2(w->cctx, &dst, &src,
+                                        finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left)) {
+                errno = EIO;
+                return -1;
+            }
+            if (write_all(w, w->out, dst.pos) == -1) return -1;
+        } while (finish ? left != 0 : src.pos < src.size);
+        return 0;
+    }
+#endif
+    (void)w;
+    (void)data;
+    (void)len;
+    (void)finish;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int compress_writer_write(CompressWriter *w, const void *data, size_t len) {
+    if (len == 0) return 0;
+    return writer_run(w, data, len, 0);
+}
+
+long long compress_writer_close(CompressWriter *w) {
+    int ret = writer_run(w, "", 0, 1);
+    int saved = errno;
+#ifdef LOKI_HAVE_ZLIB
+    if (w->format == COMPRESS_GZIP) deflateEnd(&w->zs);
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    if (w->format == COMPRESS_ZSTD) ZSTD_freeCCtx(w->cctx);
+#endif
+    long long written = w->written;
+    free(w);
+    errno = saved;
+    return ret == -1 ? -1 : written;
+}
@@ -0,0 +1,74 @@
+/* compress.h - Reading and writing gzip and zstd files
+ *
+ * loader_open() hands a file whose first bytes are a gzip or zstd magic
+ * number to compress_inflate() and loads what it decompresses to in its
+ * place, so every reader of files (editor_open(), buffer prefetches,
+ * :reload, :diff) gets the text, indexed and shown as any other.
+ *
+ * Decompression is spread over the task pool where the format splits into
+ * parts that decompress alone and say how long their output is:
+ *
+ *   - BGZF (bgzip): gzip members, each giving its length in a header
+ *     field and its output's in its trailer
+ *   - zstd frames that give their content size (as zstd -T and pzstd
+ *     write them)
+ *
+ * each part decompressing straight into its place in the output. Other
+ * gzip and zstd files are decompressed in one pass.
+ *
+ * save_model() compresses as it writes when the file name ends in .gz or
+ * .zst, streaming the rows through a CompressWriter, so the worker thread
+ * of editor_save_async() does the compressing too.
+ *
+ * Built without zlib (LOKI_HAVE_ZLIB) or libzstd (LOKI_HAVE_ZSTD), files
+ * in that format load as they are, and saves to such a name fail.
+ */
+
+#ifndef LOKI_COMPRESS_H
+#define LOKI_COMPRESS_H
+
+#include <stddef.h>
+
+typedef enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
+} CompressFormat;
+
+/* Files of fewer parts are decompressed in one pass, and parts are spread
+ * over at most this many threads */
+#define COMPRESS_PARALLEL_MIN_PARTS 2
+#define COMPRESS_MAX_WORKERS 64
+
+/* Output buffered by a CompressWriter between writes */
+#define COMPRESS_OUT_BYTES ((size_t)64 << 10)
+
+/* The format the 'size' bytes at 'data' start like, by magic number */
+CompressFormat compress_detect(const void *data, size_t size);
+
+/* The format a file named 'path' is saved in, by its extension */
+CompressFormat compress_format_for_path(const char *path);
+
+/* Was support for 'format' built in? (1 for COMPRESS_NONE) */
+int compress_supported(CompressFormat format);
+
+/* Decompress the 'size' bytes at 'data' into a new heap buffer, *out of
+ * *out_len bytes. Returns 0, or -1 with errno set: EINVAL if the data is
+ * malformed or cut short, ENOTSUP if the format was not built in. */
+int compress_inflate(CompressFormat format, const void *data, size_t size,
+                     char **out, size_t *out_len);
+
+/* Writes compressed data to a file descriptor as it is given it */
+typedef struct CompressWriter CompressWriter;
+
+/* A writer of 'format' to 'fd', or NULL with errno set */
+CompressWriter *compress_writer_open(CompressFormat format, int fd);
+
+/* Compress the 'len' bytes at 'data'. Returns 0, or -1 with errno set. */
+int compress_writer_write(CompressWriter *w, const void *data, size_t len);
+
+/* Finish the data and free the writer (whatever happens). Returns the
+ * bytes written to the descriptor in all, or -1 with errno set. */
+long long compress_writer_close(CompressWriter *w);
+
+#endif /* LOKI_COMPRESS_H */
@@ -27,24 +27,63 @@ see LICENSE.
 #include <time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
+#include <uv.h>
 
 #include "loki/editor.h"
 #include "internal.h"
 #include "selection.h"
+#include "multicursor.h"
 #include "search.h"
+#include "search_index.h"
 #include "modal.h"
 #include "command.h"
 #include "terminal.h"
 #include "undo.h"
+#include "recovery.h"
 #include "buffers.h"
+#include "changes.h"
+#include "autocmd.h"
+#include "word_index.h"
+#include "session_file.h"
 #include "syntax.h"
+#include "trace.h"
+#include "perfhud.h"
 #include "indent.h"
+#include "arena.h"
+#include "memstats.h"
+#include "hl_spans.h"
+#include "decor.h"
+#include "marks.h"
+#include "fold.h"
+#include "wrap.h"
+#include "columns.h"
+#include "ghost.h"
+#include "utf8.h"
+#include "follow.h"
+#include "reload.h"
+#include "symbols.h"
+#include "finder.h"
+#include "diffview.h"
+#include "lsp.h"
+#include "filter.h"
+#include "lazy.h"
+#include "remote.h"
 #include "lang_bridge.h"
+#include "loader.h"
+#include "save.h"
+#include "treesitter.h"
+#include "loki_markdown.h"
+#include "preview.h"
+#include "model_snapshot.h"
+#include "task_pool.h"
+#include "idle.h"
 
 void editor_set_status_msg(editor_ctx_t *ctx, const char *fmt, ...) {
     if (!ctx) return;
@@ -72,25 +111,62 @@ void editor_ctx_init(editor_ctx_t *ctx) {
     ctx->model.numrows = 0;
     /* Note: rawmode now lives in TerminalHost, not per-buffer */
     ctx->model.row = NULL;
+    ctx->model.rowcap = 0;
+    ctx->model.arena = NULL;
+    ctx->model.hl_stale_from = INT_MAX;
+    ctx->model.hl_pending = 0;
+    ctx->model.hl_idle = 0;
+    ctx->model.fences = NULL;
+    ctx->model.save_job = NULL;
+    ctx->model.search_index = NULL;
+    ctx->model.decor = NULL;
+    ctx->model.marks = NULL;
+    ctx->model.folds = NULL;
+    ctx->model.wrap = NULL;
+    ctx->model.utf8_cols = NULL;
+    ctx->model.lazy = NULL;
+    ctx->model.follow = NULL;
+    ctx->model.watch = NULL;
+    ctx->model.diff = NULL;
+    ctx->model.filter = NULL;
+    ctx->model.lsp = NULL;
+    ctx->model.damage_gen = 0;
+    ctx->model.shift_from = INT_MAX;
+    ctx->model.shift_base = 0;
+    ctx->model.edit_gen = 1;
+    ctx->model.snap_gen = 0;
+    memset(&ctx->frame, 0, sizeof(ctx->frame));
+    memset(&ctx->model.alloc_stats, 0, sizeof(ctx->model.alloc_stats));
     ctx->model.dirty = 0;
     ctx->model.filename = NULL;
+    ctx->model.lang.gen = 0;
     ctx->view.statusmsg[0] = '\0';
     ctx->view.statusmsg_time = 0;
     ctx->view.syntax = NULL;
+    editor_view_reset_derived(&ctx->view);
     ctx->lua_host = NULL;  /* Lua host is shared across buffers, set by editor_main */
     ctx->view.mode = MODE_NORMAL;
     ctx->view.word_wrap = 0;
+    ctx->view.hl_search = 0;
+    ctx->view.ignore_case = 0;
+    ctx->view.smart_case = 0;
     ctx->view.sel_active = 0;
     ctx->view.sel_start_x = 0;
     ctx->view.sel_start_y = 0;
     ctx->view.sel_end_x = 0;
     ctx->view.sel_end_y = 0;
+    ctx->view.sel_block = 0;
+    ctx->view.cursors = NULL;
+    ctx->view.cursor_count = ctx->view.cursor_cap = 0;
+    ctx->view.cursors_gen = 0;
     /* Note: winsize_changed now lives in TerminalHost, not per-buffer */
     memset(ctx->view.colors, 0, sizeof(ctx->view.colors));
     /* Command mode state */
     command_mode_init(ctx);
     /* Undo/redo system (1000 operations, 10MB memory limit) */
     undo_init(ctx, 1000, 10 * 1024 * 1024);
+    /* Unsaved edits kept on disk against a crash */
+    recovery_attach(ctx);
     /* Auto-indent system */
     indent_init(ctx);
 }
@@ -98,13 +174,30 @@ void editor_ctx_init(editor_ctx_t *ctx) {
 /* Free all dynamically allocated memory in a context.
  * This should be called when a context is no longer needed. */
 void editor_ctx_free(editor_ctx_t *ctx) {
-    /* Free all row data */
-    for (int i = 0; i < ctx->model.numrows; i++) {
-        free(ctx->model.row[i].chars);
-        free(ctx->model.row[i].render);
-        free(ctx->model.row[i].hl);
-    }
-    free(ctx->model.row);
+    /* Stop previewing it, and rendering its rows, its evaluations and
+     * its idle tasks */
+    preview_detach(ctx);
+    loki_lang_eval_detach(ctx);
+    idle_cancel_owner(ctx);
+
+    /* The filter's writes point into the rows; the language server is
+     * told the file is closed */
+    filter_stop(&ctx->model);
+    lsp_stop(&ctx->model);
+    word_index_free(&ctx->model);
+    changes_stop(&ctx->model);
+
+    /* Free all row data, and the snapshots workers are done with */
+    editor_model_free_rows(&ctx->model);
+    editor_snapshot_reap();
+    columns_free(ctx->model.columns);
+    ctx->model.columns = NULL;
+    ghost_free(ctx->model.ghost);
+    ctx->model.ghost = NULL;
+    lazy_close(&ctx->model);
+    follow_stop(&ctx->model);
+    reload_unwatch(&ctx->model);
+    diffview_stop(&ctx->model);
 
     /* Free filename */
     free(ctx->model.filename);
@@ -118,10 +211,13 @@ void editor_ctx_free(editor_ctx_t *ctx) {
         ctx->renderer = NULL;
     }
 
+    multicursor_free(&ctx->view);
+
     /* Free command mode state */
     command_mode_free(ctx);
 
-    /* Free undo/redo state */
+    /* Remove the journal of unsaved edits, then the history it follows */
+    recovery_detach(ctx);
     undo_free(ctx);
 
     /* Free indent configuration */
@@ -163,6 +259,9 @@ void editor_atexit(void) {
     /* Restore terminal via TerminalHost */
     terminal_host_disable_raw_mode(g_terminal_host);
 
+    /* The session, with --session, while the buffers are all there */
+    session_file_autosave();
+
     /* Cleanup editor resources */
     if (editor_for_atexit) {
         editor_cleanup_resources(editor_for_atexit);
@@ -172,29 +271,670 @@ void editor_atexit(void) {
 
 /* ======================= Editor rows implementation ======================= */
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editor_update_row(editor_ctx_t *ctx, t_erow *row) {
-    unsigned int tabs = 0;
-    int j, idx;
+/* Capacity to grow a buffer of 'cap' bytes to so it holds 'need' bytes. */
+static size_t buf_grow_size(int cap, size_t need) {
+    size_t newcap = cap ? (size_t)cap * 2 : need;
+    if (newcap < need) newcap = need;
+    if (newcap > INT_MAX) newcap = need;
+    if (newcap > INT_MAX) {
+        printf("Some line of the edited file is too long for loki\n");
+        exit(1);
+    }
+    return newcap;
+}
 
-   /* Create a version of the row we can directly print on the screen,
-     * respecting tabs, substituting non printable characters with '?'. */
-    free(row->render);
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == TAB) tabs++;
+void *editor_buf_reserve(void *buf, int *cap, size_t need, unsigned long *allocs) {
+    if (need == 0) need = 1;
+    if (buf != NULL && need <= (size_t)*cap) return buf;
 
-    unsigned long long allocsize =
-        (unsigned long long) row->size + tabs*8 + 1;
-    if (allocsize > UINT32_MAX) {
-        printf("Some line of the edited file is too long for loki\n");
+    size_t newcap = buf_grow_size(*cap, need);
+    void *p = realloc(buf, newcap);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *cap = (int)newcap;
+    if (allocs) (*allocs)++;
+    return p;
+}
+
+void editor_model_use_arena(EditorModel *model) {
+#ifdef LOKI_NO_ROW_ARENA
+    (void)model;
+#else
+    if (model->arena != NULL) return;
+    model->arena = arena_create();
+    if (model->arena == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+#endif
+}
+
+/* Detach a row from its shared contents, leaving it no chars block; the
+ * caller releases the share. */
+static RowShare *row_unshare(t_erow *row) {
+    RowShare *share = row->share;
+    row->share = NULL;
+    row->chars = NULL;
+    row->chars_cap = 0;
+    row->arena_bufs &= ~ROW_BUF_CHARS;
+    return share;
+}
+
+/* About to change the rows: the threads reading them (a save in flight,
+ * a search index build) let go of them first. */
+static void model_will_change(EditorModel *model) {
+    editor_save_wait(model);
+    search_index_stop(model);
+}
+
+void *editor_row_reserve(EditorModel *model, t_erow *row, int which,
+                         size_t need, unsigned long *allocs) {
+    void *buf;
+    int *cap;
+
+    /* A save in flight may be reading the chars being replaced. */
+    if (which == ROW_BUF_CHARS) model_will_change(model);
+
+    /* A render that is chars gets a buffer of its own once written to */
+    if (which == ROW_BUF_RENDER && (row->arena_bufs & ROW_BUF_ALIAS)) {
+        row->render = NULL;
+        row->render_cap = 0;
+        row->arena_bufs &= ~ROW_BUF_ALIAS;
+    }
+
+    /* Packed runs are rewritten in full: start over with bytes */
+    if (which == ROW_BUF_HL && (row->arena_bufs & ROW_BUF_SPANS)) {
+        mem_free(MEM_TAG_SYNTAX, row->hl_buf.hl_spans);
+        row->hl_buf.hl = NULL;
+        row->hl_cap = 0;
+        row->arena_bufs &= ~ROW_BUF_SPANS;
+    }
+
+    /* Mapped contents are read-only: write to a copy of them */
+    if (which == ROW_BUF_CHARS && (row->arena_bufs & ROW_BUF_MAPPED)) {
+        size_t keep = (size_t)row->size + 1;
+        const char *mapped = row->chars;
+        row->chars = NULL;
+        row->chars_cap = 0;
+        row->arena_bufs &= ~ROW_BUF_MAPPED;
+        buf = editor_row_reserve(model, row, which, need > keep ? need : keep,
+                                 allocs);
+        memcpy(buf, mapped, keep);
+        return buf;
+    }
+
+    /* Shared contents are read-only: write to a copy of them, unless no
+     * one else holds them any more */
+    if (which == ROW_BUF_CHARS && row->share) {
+        size_t keep = (size_t)row->size + 1;
+        RowShare *share = row_unshare(row);
+        if (share->refs == 1 && share->map == NULL &&
+            (share->arena == NULL || share->arena == model->arena)) {
+            row->chars = share->chars;
+            row->chars_cap = share->cap;
+            if (share->arena) {
+                row->arena_bufs |= ROW_BUF_CHARS;
+                arena_destroy(share->arena);    /* Drops the share's hold */
+            }
+            free(share);
+            return editor_row_reserve(model, row, which, need, allocs);
+        }
+        buf = editor_row_reserve(model, row, which, need > keep ? need : keep,
+                                 allocs);
+        memcpy(buf, share->chars, keep);
+        editor_row_share_release(share);
+        return buf;
+    }
+
+    switch (which) {
+    case ROW_BUF_CHARS:  buf = row->chars;  cap = &row->chars_cap;  break;
+    case ROW_BUF_RENDER: buf = row->render; cap = &row->render_cap; break;
+    default:             buf = row->hl_buf.hl;     cap = &row->hl_cap;     break;
+    }
+
+    if (need == 0) need = 1;
+    if (buf != NULL && need <= (size_t)*cap) return buf;
+
+    RowArena *arena = model->arena;
+    if (arena == NULL || (buf != NULL && *cap == 0)) {
+        /* No arena, or a heap block of unknown size that can only be
+         * grown by realloc(). */
+        buf = editor_buf_reserve(buf, cap, need, allocs);
+    } else {
+        int newcap;
+        void *p = arena_alloc(arena, buf_grow_size(*cap, need), &newcap);
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (buf != NULL) {
+            memcpy(p, buf, (size_t)*cap);
+            if (row->arena_bufs & which) arena_free(arena, buf, *cap);
+            else free(buf);
+        }
+        buf = p;
+        *cap = newcap;
+        row->arena_bufs |= which;
+        if (allocs) (*allocs)++;
+    }
+
+    switch (which) {
+    case ROW_BUF_CHARS:
+        row->chars = buf;
+        if (row->arena_bufs & ROW_BUF_ALIAS) row->render = buf;
+        break;
+    case ROW_BUF_RENDER: row->render = buf; break;
+    default:             row->hl_buf.hl = buf;     break;
+    }
+    return buf;
+}
+
+/* Free one row buffer allocated by editor_row_reserve() or the heap. */
+static void row_buf_free(EditorModel *model, t_erow *row, int which,
+                         void *buf, int cap) {
+    if (row->arena_bufs & which) arena_free(model->arena, buf, cap);
+    else if (which == ROW_BUF_HL && (row->arena_bufs & ROW_BUF_SPANS))
+        mem_free(MEM_TAG_SYNTAX, buf);
+    else if (which != ROW_BUF_CHARS || !(row->arena_bufs & ROW_BUF_MAPPED)) free(buf);
+}
+
+RowShare *editor_row_share(EditorModel *model, t_erow *row) {
+    if (row->share == NULL) {
+        RowShare *share = malloc(sizeof(*share));
+        if (share == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        share->refs = 1;                        /* The row's */
+        share->len = row->size;
+        share->cap = row->chars_cap;
+        share->chars = row->chars;
+        share->arena = row->arena_bufs & ROW_BUF_CHARS ? model->arena : NULL;
+        if (share->arena) arena_retain(share->arena);
+        /* Mapped contents hold the mapping, which may outlive the rows */
+        share->map = row->arena_bufs & ROW_BUF_MAPPED ? model->row_map : NULL;
+        if (share->map) share->map->refs++;
+        row->arena_bufs &= ~(ROW_BUF_CHARS | ROW_BUF_MAPPED);
+        row->share = share;
+    }
+    row->share->refs++;
+    return row->share;
+}
+
+void editor_row_share_release(RowShare *share) {
+    if (share == NULL || --share->refs > 0) return;
+    if (share->map) {
+        editor_row_map_release(share->map);
+    } else if (share->arena) {
+        arena_free(share->arena, share->chars, share->cap);
+        arena_destroy(share->arena);
+    } else {
+        free(share->chars);
+    }
+    free(share);
+}
+
+RowMap *editor_row_map_new(void *base, size_t len) {
+    RowMap *map = malloc(sizeof(*map));
+    if (map == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    map->refs = 1;                              /* The model's */
+    map->base = base;
+    map->len = len;
+    return map;
+}
+
+void editor_row_map_release(RowMap *map) {
+    if (map == NULL || --map->refs > 0) return;
+    munmap(map->base, map->len);
+    free(map);
+}
+
+/* ============================ Counts ===================================== */
+
+/* Runs of bytes other than blanks in the 'len' bytes at 's' */
+static int count_words(const char *s, int len) {
+    int words = 0, in_word = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        int blank = c == ' ' || (c >= '\t' && c <= '\r');
+        words += !blank & !in_word;
+        in_word = !blank;
+    }
+    return words;
+}
+
+/* Words are counted a row at a time: a row's count is taken out of the
+ * model's and put back recounted as it changes. Bytes follow the lengths
+ * note_edit() and note_range_edit() are given, newlines included. */
+static void counts_drop_row(EditorModel *model, const t_erow *row) {
+    model->count_words -= row->count_words;
+}
+
+static void counts_add_row(EditorModel *model, t_erow *row) {
+    row->count_words = count_words(row->chars, row->size);
+    model->count_words += row->count_words;
+}
+
+EditorCounts editor_model_counts(EditorModel *model) {
+    if (!model->counts_kept) {
+        model->count_bytes = model->numrows;
+        model->count_words = 0;
+        for (int j = 0; j < model->numrows; j++) {
+            model->count_bytes += model->row[j].size;
+            counts_add_row(model, &model->row[j]);
+        }
+        model->counts_kept = 1;
+    }
+    EditorCounts c;
+    c.bytes = model->count_bytes;
+    c.words = model->count_words;
+    c.lines = model->numrows;
+    return c;
+}
+
+void editor_free_row(EditorModel *model, t_erow *row) {
+    if (model->counts_kept) counts_drop_row(model, row);
+    if (row->share) editor_row_share_release(row_unshare(row));
+    if (!(row->arena_bufs & ROW_BUF_ALIAS))
+        row_buf_free(model, row, ROW_BUF_RENDER, row->render, row->render_cap);
+    row_buf_free(model, row, ROW_BUF_CHARS, row->chars, row->chars_cap);
+    row_buf_free(model, row, ROW_BUF_HL, row->hl_buf.hl, row->hl_cap);
+    free(row->colindex);
+    row->render = row->chars = NULL;
+    row->hl_buf.hl = NULL;
+    row->colindex = NULL;
+    row->render_cap = row->chars_cap = row->hl_cap = 0;
+    row->arena_bufs = 0;
+}
+
+void editor_row_pack_hl(EditorModel *model, t_erow *row) {
+    if (row->hl_buf.hl == NULL || (row->arena_bufs & ROW_BUF_SPANS)) return;
+    int count = hl_run_count(row->hl_buf.hl, row->rsize);
+    if (HL_SPAN_BLOCK_SIZE(count) > (size_t)row->rsize / 2) return;
+
+    HlSpanBlock *block = hl_span_block_pack(row->hl_buf.hl, row->rsize, count);
+    if (block == NULL) return;          /* Bytes will do */
+    row_buf_free(model, row, ROW_BUF_HL, row->hl_buf.hl, row->hl_cap);
+    row->hl_buf.hl_spans = block;
+    row->hl_cap = 0;
+    row->arena_bufs = (row->arena_bufs & ~ROW_BUF_HL) | ROW_BUF_SPANS;
+}
+
+unsigned char *editor_row_hl(t_erow *row) {
+    if (!(row->arena_bufs & ROW_BUF_SPANS)) return row->hl_buf.hl;
+
+    unsigned char *hl = malloc(row->rsize ? (size_t)row->rsize : 1);
+    if (hl == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    hl_span_block_unpack(row->hl_buf.hl_spans, 0, row->rsize, hl);
+    mem_free(MEM_TAG_SYNTAX, row->hl_buf.hl_spans);
+    row->hl_buf.hl = hl;
+    row->hl_cap = row->rsize ? row->rsize : 1;
+    row->arena_bufs &= ~ROW_BUF_SPANS;
+    return hl;
+}
+
+unsigned char editor_row_hl_at(const t_erow *row, int col) {
+    if (row->hl_buf.hl == NULL || col < 0 || col >= row->rsize) return HL_NORMAL;
+    if (row->arena_bufs & ROW_BUF_SPANS)
+        return hl_span_block_at(row->hl_buf.hl_spans, col);
+    return row->hl_buf.hl[col];
+}
+
+void editor_row_hl_read(const t_erow *row, int from, int len,
+                        unsigned char *out) {
+    if (len <= 0) return;
+    if (row->hl_buf.hl == NULL) memset(out, HL_NORMAL, (size_t)len);
+    else if (row->arena_bufs & ROW_BUF_SPANS)
+        hl_span_block_unpack(row->hl_buf.hl_spans, from, len, out);
+    else memcpy(out, row->hl_buf.hl + from, (size_t)len);
+}
+
+void editor_row_hl_spans(const t_erow *row, int from, int len,
+                         HlSpans *spans) {
+    if (row->hl_buf.hl == NULL) hl_spans_push(spans, 0, len, HL_NORMAL);
+    else if (row->arena_bufs & ROW_BUF_SPANS)
+        hl_spans_from_block(spans, row->hl_buf.hl_spans, from, len);
+    else hl_spans_from_bytes(spans, row->hl_buf.hl, from, len);
+}
+
+typedef struct {
+    t_erow *row;
+    int from, len;
+    HlSpans *spans;
+} DecorOverlay;
+
+static void overlay_decor(void *opaque, const Decor *d) {
+    DecorOverlay *o = opaque;
+    int base = o->row->render_off + o->from;
+    int start = editor_row_cx_to_rx(o->row, d->col) - base;
+    int end = editor_row_cx_to_rx(o->row, d->end) - base;
+    if (start < 0) start = 0;
+    if (end > o->len) end = o->len;
+    hl_spans_overlay(o->spans, start, end - start, d->hl);
+}
+
+void editor_row_draw_spans(EditorModel *model, t_erow *row, int filerow,
+                           int from, int len, HlSpans *spans) {
+    editor_row_hl_spans(row, from, len, spans);
+    if (model->decor == NULL) return;
+    DecorOverlay o = { row, from, len, spans };
+    decor_row_each(model->decor, filerow, overlay_decor, &o);
+}
+
+int editor_decorate(EditorModel *model, int group, int filerow, int col,
+                    int len, unsigned char hl) {
+    if (filerow < 0 || filerow >= model->numrows) return -1;
+    if (model->decor == NULL && (model->decor = decor_layer_new()) == NULL)
+        return -1;
+    if (decor_add(model->decor, group, filerow, col, len, hl) != 0) return -1;
+    editor_row_damage(model, &model->row[filerow]);
+    return 0;
+}
+
+static void damage_decor_row(void *opaque, const Decor *d) {
+    EditorModel *model = opaque;
+    if (d->row < model->numrows) editor_row_damage(model, &model->row[d->row]);
+}
+
+void editor_undecorate(EditorModel *model, int group) {
+    decor_clear(model->decor, group, damage_decor_row, model);
+}
+
+void editor_undecorate_rows(EditorModel *model, int group, int first, int last) {
+    decor_clear_rows(model->decor, group, first, last, damage_decor_row, model);
+}
+
+int editor_mark_add(EditorModel *model, int row, int col, int right_gravity) {
+    if (model->marks == NULL && (model->marks = marks_new()) == NULL)
+        return -1;
+    return marks_add(model->marks, row, col, right_gravity);
+}
+
+int editor_fold_add(EditorModel *model, int first, int last, int closed) {
+    if (model->folds == NULL && (model->folds = fold_set_new()) == NULL)
+        return -1;
+    if (last >= model->numrows) last = model->numrows - 1;
+    return fold_add(model->folds, first, last, closed);
+}
+
+void editor_model_free_rows(EditorModel *model) {
+    model_will_change(model);
+    model->counts_kept = 0;
+    for (int i = 0; i < model->numrows; i++) {
+        t_erow *row = &model->row[i];
+        if (row->share) editor_row_share_release(row_unshare(row));
+        if (!(row->arena_bufs & (ROW_BUF_CHARS | ROW_BUF_MAPPED))) free(row->chars);
+        if (!(row->arena_bufs & (ROW_BUF_RENDER | ROW_BUF_ALIAS))) free(row->render);
+        if (row->arena_bufs & ROW_BUF_SPANS)
+            mem_free(MEM_TAG_SYNTAX, row->hl_buf.hl_spans);
+        else if (!(row->arena_bufs & ROW_BUF_HL)) free(row->hl_buf.hl);
+        free(row->colindex);
+    }
+    arena_destroy(model->arena);
+    model->arena = NULL;
+    editor_row_map_release(model->row_map);
+    model->row_map = NULL;
+    mem_free(MEM_TAG_CORE, model->row);
+    model->row = NULL;
+    model->numrows = 0;
+    model->rowcap = 0;
+    model->hl_stale_from = INT_MAX;
+    model->hl_pending = 0;
+    model->snap_gen = 0;        /* Checkpoints start again with a base */
+    markdown_fences_free(model);
+    search_index_disable(model);
+    loki_markdown_cache_free(model);
+    decor_layer_free(model->decor);
+    model->decor = NULL;
+    marks_free(model->marks);
+    model->marks = NULL;
+    fold_set_free(model->folds);
+    model->folds = NULL;
+    wrap_cache_free(model->wrap);
+    model->wrap = NULL;
+    columns_clear(model->columns);
+    utf8_cols_free(model->utf8_cols);
+    model->utf8_cols = NULL;
+    editor_snapshot_note_change(model);
+    editor_model_damage_shift(model, 0);
+#ifdef LOKI_USE_LINENOISE
+    treesitter_reset(model->ts_state);
+#endif
+}
+
+/* Make room for at least 'need' rows in the row array, doubling its
+ * capacity so that appending rows one by one is amortized O(1). */
+static void model_reserve_rows(EditorModel *model, size_t need) {
+    if (need <= (size_t)model->rowcap) return;
+
+    size_t newcap = model->rowcap ? (size_t)model->rowcap * 2 : 16;
+    if (newcap < need) newcap = need;
+    if (newcap > INT_MAX) newcap = need;
+    /* Check for integer overflow in allocation size calculation */
+    if (newcap > INT_MAX || newcap >= SIZE_MAX / sizeof(t_erow)) {
+        fprintf(stderr, "Too many rows, cannot allocate more memory\n");
         exit(1);
     }
 
-    row->render = malloc(row->size + tabs*8 + 1);
-    if (row->render == NULL) {
+    t_erow *new_row = mem_realloc(MEM_TAG_CORE, model->row, sizeof(t_erow) * newcap);
+    if (new_row == NULL) {
         perror("Out of memory");
         exit(1);
     }
+    model->row = new_row;
+    model->rowcap = (int)newcap;
+    model->alloc_stats.row_array++;
+}
+
+/* =========================== Long rows ================================== */
+
+/* Render column after drawing chars[from, to) starting at column 'col'.
+ * TAB stops are those of build_row_render(). */
+static int advance_col(const char *chars, int from, int to, int col) {
+    for (int j = from; j < to; j++) {
+        if (chars[j] == TAB) {
+            col++;
+            while ((col + 1) % 8 != 0) col++;
+        } else {
+            col++;
+        }
+    }
+    return col;
+}
+
+/* Size the column index for the row and drop entries past its end. */
+static void colindex_fit(t_erow *row) {
+    int need = row->size / ROW_LONG_CHUNK + 1;
+    t_colindex *ci = row->colindex;
+
+    if (ci == NULL || ci->cap < need) {
+        int cap = ci ? ci->cap : 0;
+        if (cap < 16) cap = 16;
+        while (cap < need) cap *= 2;
+        t_colindex *p = realloc(ci, sizeof(*ci) + (size_t)cap * sizeof(int));
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (ci == NULL) {
+            p->valid = 1;
+            p->col[0] = 0;
+        }
+        p->cap = cap;
+        row->colindex = ci = p;
+    }
+    if (ci->valid > need) ci->valid = need;
+}
+
+/* Forget index entries that an edit at chars[at] may have moved. */
+static void colindex_invalidate(t_erow *row, int at) {
+    if (row->colindex == NULL) return;
+    int keep = at / ROW_LONG_CHUNK + 1;
+    if (row->colindex->valid > keep) row->colindex->valid = keep;
+}
+
+/* Extend the index so entry k is valid (k within the row). */
+static void colindex_extend(t_erow *row, int k) {
+    t_colindex *ci = row->colindex;
+    while (ci->valid <= k) {
+        int from = (ci->valid - 1) * ROW_LONG_CHUNK;
+        ci->col[ci->valid] = advance_col(row->chars, from,
+                                         from + ROW_LONG_CHUNK,
+                                         ci->col[ci->valid - 1]);
+        ci->valid++;
+    }
+}
+
+/* Index of the char drawn at render column 'col' (the row's end if 'col'
+ * is past it) of a long row; its own column goes to *char_col. */
+static int long_row_char_at(t_erow *row, int col, int *char_col) {
+    t_colindex *ci = row->colindex;
+    int last = row->size / ROW_LONG_CHUNK;
+
+    /* Chunk holding 'col': extend the index until the next one starts past it */
+    int k = 0;
+    while (k < last) {
+        if (k + 1 >= ci->valid) colindex_extend(row, k + 1);
+        if (ci->col[k + 1] > col) break;
+        k++;
+    }
+
+    int j = k * ROW_LONG_CHUNK, c = ci->col[k];
+    while (j < row->size) {
+        int next = advance_col(row->chars, j, j + 1, c);
+        if (next > col) break;
+        c = next;
+        j++;
+    }
+    *char_col = c;
+    return j;
+}
+
+int editor_row_cx_to_rx(t_erow *row, int cx) {
+    if (cx > row->size) cx = row->size;
+    if (row->colindex == NULL) return advance_col(row->chars, 0, cx, 0);
+
+    int k = cx / ROW_LONG_CHUNK;
+    colindex_extend(row, k);
+    return advance_col(row->chars, k * ROW_LONG_CHUNK, cx, row->colindex->col[k]);
+}
+
+int editor_row_cells(EditorModel *model, t_erow *row, int from, int to) {
+    if (row->render == NULL) editor_row_render(model, row, &model->alloc_stats);
+    from -= row->render_off;
+    to -= row->render_off;
+    if (from < 0) from = 0;
+    if (to > row->rsize) to = row->rsize;
+    if (to <= from) return 0;
+
+    if (model->utf8_cols == NULL) model->utf8_cols = utf8_cols_new();
+    int r = (int)(row - model->row);
+    return utf8_cols_at(model->utf8_cols, r, row->damage_gen, row->render,
+                        row->rsize, to) -
+           utf8_cols_at(model->utf8_cols, r, row->damage_gen, row->render,
+                        row->rsize, from);
+}
+
+int editor_row_cell_to_cx(t_erow *row, int rx, int cells) {
+    int j = 0, c = 0;
+    if (row->colindex) j = long_row_char_at(row, rx, &c);
+    for (; j < row->size && c < rx; j++)
+        c = advance_col(row->chars, j, j + 1, c);
+    while (j < row->size && utf8_is_cont(row->chars[j])) j++;
+
+    /* On through the chars before the one drawn 'cells' cells right */
+    int used = 0;
+    while (j < row->size) {
+        int n = 1, w;
+        if (row->chars[j] == TAB) {
+            w = advance_col(row->chars, j, j + 1, c) - c;
+        } else {
+            int cp;
+            n = utf8_decode(row->chars + j, row->size - j, &cp);
+            w = utf8_cp_width(cp);
+        }
+        if (used + w > cells) break;
+        used += w;
+        c += row->chars[j] == TAB ? w : n;
+        j += n;
+    }
+    return j;
+}
+
+/* Render the window of a long row starting at (about) render_off: the
+ * start moves back to the first column of the char drawn there. */
+static void build_long_render(EditorModel *model, t_erow *row,
+                              EditorAllocStats *stats) {
+    colindex_fit(row);
+
+    int col;
+    int j = long_row_char_at(row, row->render_off, &col);
+    editor_row_reserve(model, row, ROW_BUF_RENDER, ROW_LONG_WINDOW + 8 + 1,
+                       &stats->render);
+
+    int idx = 0;
+    row->render_off = col;
+    for (; j < row->size && idx < ROW_LONG_WINDOW; j++) {
+        if (row->chars[j] == TAB) {
+            row->render[idx++] = ' ';
+            col++;
+            while ((col + 1) % 8 != 0) {
+                row->render[idx++] = ' ';
+                col++;
+            }
+        } else {
+            row->render[idx++] = row->chars[j];
+            col++;
+        }
+    }
+    row->rsize = idx;
+    row->render[idx] = '\0';
+}
+
+/* Rebuild the rendered version of a row whose TAB count is already known.
+ * Without TABs render is chars itself (ROW_BUF_ALIAS), non-printable bytes
+ * being left for the screen to substitute; otherwise the render buffer is
+ * reused in place when it is large enough. Long rows only render their
+ * window (see ROW_LONG_MIN); 'tabs' is unused for them. */
+static void build_row_render(EditorModel *model, t_erow *row, unsigned int tabs,
+                             EditorAllocStats *stats) {
+    int j, idx;
+
+    if (row->size >= ROW_LONG_MIN) {
+        build_long_render(model, row, stats);
+        return;
+    }
+    if (row->colindex) {
+        /* Shrunk below the threshold: back to a full render */
+        free(row->colindex);
+        row->colindex = NULL;
+        row->render_off = 0;
+    }
+
+    if (tabs == 0) {
+        if (!(row->arena_bufs & ROW_BUF_ALIAS)) {
+            row_buf_free(model, row, ROW_BUF_RENDER, row->render, row->render_cap);
+            row->render_cap = 0;
+            row->arena_bufs = (row->arena_bufs & ~ROW_BUF_RENDER) | ROW_BUF_ALIAS;
+        }
+        row->render = row->chars;
+        row->rsize = row->size;
+        return;
+    }
+
+    /* Create a version of the row we can directly print on the screen,
+     * expanding tabs. */
+    size_t allocsize = (size_t)row->size + tabs*8 + 1;
+
+    editor_row_reserve(model, row, ROW_BUF_RENDER, allocsize, &stats->render);
     idx = 0;
     for (j = 0; j < row->size; j++) {
         if (row->chars[j] == TAB) {
@@ -206,53 +946,215 @@ void editor_update_row(editor_ctx_t *ctx, t_erow *row) {
     }
     row->rsize = idx;
     row->render[idx] = '\0';
+}
 
-    /* Update the syntax highlighting attributes of the row. */
-    syntax_update_row(ctx, row);
+/* Rebuild the rendered version of a row whose TAB count is already known.
+ * The render is cheap and needed for cursor math, so it is rebuilt now;
+ * the highlight is only marked stale and recomputed when the row is read
+ * through syntax_fresh_row(). */
+static void update_row_render(editor_ctx_t *ctx, t_erow *row, unsigned int tabs) {
+    build_row_render(&ctx->model, row, tabs, &ctx->model.alloc_stats);
+    syntax_invalidate_row(ctx, row);
+    editor_row_damage(&ctx->model, row);
 }
 
-/* Insert a row at the specified position, shifting the other rows on the bottom
- * if required. */
-void editor_insert_row(editor_ctx_t *ctx, int at, char *s, size_t len) {
-    if (at > ctx->model.numrows) return;
-    /* Check for integer overflow in allocation size calculation */
-    if ((size_t)ctx->model.numrows >= SIZE_MAX / sizeof(t_erow)) {
-        fprintf(stderr, "Too many rows, cannot allocate more memory\n");
-        exit(1);
+/* TABs in a row, for build_row_render(); 0 for long rows, which count
+ * their columns through the colindex instead. */
+static unsigned int row_tabs(const t_erow *row) {
+    unsigned int tabs = 0;
+    if (row->size >= ROW_LONG_MIN) return 0;
+    for (int j = 0; j < row->size; j++)
+        if (row->chars[j] == TAB) tabs++;
+    return tabs;
+}
+
+void editor_row_render(EditorModel *model, t_erow *row, EditorAllocStats *stats) {
+    if (row->render == NULL) build_row_render(model, row, row_tabs(row), stats);
+}
+
+static int render_on_demand;
+
+void editor_set_render_on_demand(int on) {
+    render_on_demand = on != 0;
+}
+
+int editor_get_render_on_demand(void) {
+    return render_on_demand;
+}
+
+/* Update the rendered version of a row changed from chars[at] onwards. */
+static void update_row_from(editor_ctx_t *ctx, t_erow *row, int at) {
+    search_index_note_change(&ctx->model, (int)(row - ctx->model.row));
+    loki_markdown_cache_note_change(&ctx->model, (int)(row - ctx->model.row));
+    wrap_note_change(ctx->model.wrap, (int)(row - ctx->model.row));
+    columns_note_change(ctx->model.columns, (int)(row - ctx->model.row));
+    editor_snapshot_note_change(&ctx->model);
+    row->edit_gen = ctx->model.edit_gen;
+    if (ctx->model.counts_kept) {
+        counts_drop_row(&ctx->model, row);
+        counts_add_row(&ctx->model, row);
     }
-    t_erow *new_row = realloc(ctx->model.row,sizeof(t_erow)*(ctx->model.numrows+1));
-    if (new_row == NULL) {
-        perror("Out of memory");
-        exit(1);
+
+    /* A long row's window is re-rendered; no need to look at the rest */
+    if (row->size >= ROW_LONG_MIN) colindex_invalidate(row, at);
+    update_row_render(ctx, row, row_tabs(row));
+}
+
+/* Update the rendered version of a row and mark its highlight stale. The
+ * row may have been rewritten in place, so the document tree is reparsed. */
+void editor_update_row(editor_ctx_t *ctx, t_erow *row) {
+#ifdef LOKI_USE_LINENOISE
+    treesitter_reset(ctx->model.ts_state);
+#endif
+    update_row_from(ctx, row, 0);
+}
+
+t_erow *editor_visible_row(editor_ctx_t *ctx, int filerow, int col, int cols) {
+    t_erow *row = model_row(&ctx->model, filerow);
+    if (row == NULL) return NULL;
+
+    if (row->render == NULL) update_row_render(ctx, row, row_tabs(row));
+    if (row->colindex) {
+        int start = row->render_off, end = start + row->rsize;
+        int covered = col >= start &&
+                      (col + cols <= end || row->rsize < ROW_LONG_WINDOW);
+        if (!covered) {
+            /* Re-center with room to scroll either way */
+            row->render_off = col > ROW_LONG_WINDOW / 4 ? col - ROW_LONG_WINDOW / 4 : 0;
+            update_row_render(ctx, row, 0);
+        }
+    }
+    /* Rows syntax_fresh_rows() showed ahead of the rows above them stay
+     * as they are until it has caught up */
+    if (ctx->model.hl_pending && !row->hl_stale) return row;
+    return syntax_fresh_row(ctx, filerow);
+}
+
+/* Tell the document tree, the decorations, the marks, the folds, a diff,
+ * a language server and watches of the edits that old_len bytes at (row, col) became new_len.
+ * 'lines' is n > 0 when n whole lines are inserted at (row, 0), -n when n
+ * are deleted there, and 0 for an edit within the row. */
+static void note_edit(editor_ctx_t *ctx, int row, int col, uint32_t old_len,
+                      uint32_t new_len, int lines) {
+    int old_row = row, old_col = col + (int)old_len;
+    int new_row = row, new_col = col + (int)new_len;
+    if (lines > 0) {
+        old_col = 0;
+        new_row = row + lines;
+        new_col = 0;
+    } else if (lines < 0) {
+        old_row = row - lines;
+        old_col = 0;
+        new_col = 0;
+    }
+    if (ctx->model.counts_kept) ctx->model.count_bytes += (long long)new_len - old_len;
+    decor_note_edit(ctx->model.decor, row, col, old_row, old_col,
+                    new_row, new_col);
+    diffview_note_edit(&ctx->model, row, old_row, new_row);
+    lsp_note_edit(&ctx->model, row, old_row, new_row);
+    changes_note_edit(&ctx->model, row, old_row, new_row);
+    marks_note_edit(ctx->model.marks, row, col, old_row, old_col,
+                    new_row, new_col);
+    fold_note_edit(ctx->model.folds, row, col, old_row, old_col,
+                   new_row, new_col);
+
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state == NULL) return;
+
+    TSPoint start = { (uint32_t)row, (uint32_t)col };
+    TSPoint old_end = { (uint32_t)old_row, (uint32_t)old_col };
+    TSPoint new_end = { (uint32_t)new_row, (uint32_t)new_col };
+    treesitter_note_edit(ctx->model.ts_state, &ctx->model, start, old_end,
+                         old_len, new_end, new_len);
+#endif
+}
+
+/* Page size of model.row_map, for line_viewable() */
+static size_t view_page;
+
+/* Have 'row' use the 'len' bytes at 's', a line of model.row_map, where
+ * they are. Its NUL goes over the line's end of line, or past the end of the
+ * file in the zeroed rest of its last page. */
+static void view_row(t_erow *row, char *s, size_t len) {
+    row->chars = s;
+    row->chars[len] = '\0';
+    row->chars_cap = 0;
+    row->arena_bufs = ROW_BUF_MAPPED;
+}
+
+/* Set up a new row slot holding the 'len' bytes at 's', not yet rendered;
+ * with 'view', the row uses them where they are (view_row()). */
+static void init_row(EditorModel *model, t_erow *row, const char *s,
+                     size_t len, int view) {
+    row->size = len;
+    row->chars = NULL;
+    row->chars_cap = 0;
+    row->arena_bufs = 0;
+    row->share = NULL;
+    if (view) {
+        view_row(row, (char *)s, len);
+    } else {
+        editor_row_reserve(model, row, ROW_BUF_CHARS, len+1,
+                           &model->alloc_stats.chars);
+        memcpy(row->chars,s,len);
+        row->chars[len] = '\0';
     }
-    ctx->model.row = new_row;
+    row->hl_buf.hl = NULL;
+    row->hl_cap = 0;
+    row->hl_oc = 0;
+    row->hl_stale = 1;
+    row->hl_hooked = 0;
+    row->cb_lang = CB_LANG_NONE;
+    row->cb_entry = CB_LANG_NONE;
+    row->csd_section = 0;
+    row->render = NULL;
+    row->render_cap = 0;
+    row->rsize = 0;
+    row->damage_gen = 0;
+    row->edit_gen = model->edit_gen;
+    row->render_off = 0;
+    row->colindex = NULL;
+    if (model->counts_kept) counts_add_row(model, row);
+}
+
+/* Insert a row at the specified position, shifting the other rows on the bottom
+ * if required. 'tabs' is the number of TABs in 's', or -1 if unknown. With
+ * 'view', 's' is a line of model.row_map the row uses where it is (see
+ * view_row()). */
+static void insert_row(editor_ctx_t *ctx, int at, const char *s, size_t len,
+                       int tabs, int view) {
+    if (at > ctx->model.numrows) return;
+    model_will_change(&ctx->model);
+    model_reserve_rows(&ctx->model, (size_t)ctx->model.numrows + 1);
     if (at != ctx->model.numrows) {
         memmove(ctx->model.row+at+1,ctx->model.row+at,sizeof(ctx->model.row[0])*(ctx->model.numrows-at));
-        for (int j = at+1; j <= ctx->model.numrows; j++) ctx->model.row[j].idx++;
     }
-    ctx->model.row[at].size = len;
-    ctx->model.row[at].chars = malloc(len+1);
-    if (ctx->model.row[at].chars == NULL) {
-        perror("Out of memory");
-        exit(1);
-    }
-    memcpy(ctx->model.row[at].chars,s,len+1);
-    ctx->model.row[at].hl = NULL;
-    ctx->model.row[at].hl_oc = 0;
-    ctx->model.row[at].cb_lang = CB_LANG_NONE;
-    ctx->model.row[at].render = NULL;
-    ctx->model.row[at].rsize = 0;
-    ctx->model.row[at].idx = at;
-    editor_update_row(ctx, ctx->model.row+at);
+    init_row(&ctx->model, ctx->model.row+at, s, len, view);
     ctx->model.numrows++;
+    editor_model_damage_shift(&ctx->model, at);
+    search_index_note_insert(&ctx->model, at);
+    loki_markdown_cache_note_insert(&ctx->model, at);
+    wrap_note_insert(ctx->model.wrap, at);
+    columns_note_insert(ctx->model.columns, at);
+    editor_snapshot_note_change(&ctx->model);
+    note_edit(ctx, at, 0, 0, (uint32_t)len + 1, 1);
+    if (tabs < 0) {
+        update_row_from(ctx, ctx->model.row+at, 0);
+    } else if (tabs > 0 && render_on_demand && len < ROW_LONG_MIN) {
+        /* Rendered when first shown or highlighted */
+        syntax_invalidate_row(ctx, ctx->model.row+at);
+        editor_row_damage(&ctx->model, ctx->model.row+at);
+    } else {
+        update_row_render(ctx, ctx->model.row+at, (unsigned int)tabs);
+    }
+    /* The row below now follows a different line. */
+    if (at+1 < ctx->model.numrows)
+        syntax_invalidate_row(ctx, ctx->model.row+at+1);
     ctx->model.dirty++;
 }
 
-/* Free row's heap allocated stuff. */
-void editor_free_row(t_erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void editor_insert_row(editor_ctx_t *ctx, int at, char *s, size_t len) {
+    insert_row(ctx, at, s, len, -1, 0);
 }
 
 /* Remove the row at the specified position, shifting the remaining on the
@@ -261,104 +1163,216 @@ void editor_del_row(editor_ctx_t *ctx, int at) {
     t_erow *row;
 
     if (at >= ctx->model.numrows) return;
+    model_will_change(&ctx->model);
     row = ctx->model.row+at;
-    editor_free_row(row);
+    note_edit(ctx, at, 0, (uint32_t)row->size + 1, 0, -1);
+    editor_free_row(&ctx->model, row);
     memmove(ctx->model.row+at,ctx->model.row+at+1,sizeof(ctx->model.row[0])*(ctx->model.numrows-at-1));
-    for (int j = at; j < ctx->model.numrows-1; j++) ctx->model.row[j].idx++;
     ctx->model.numrows--;
+    editor_model_damage_shift(&ctx->model, at);
+    search_index_note_delete(&ctx->model, at);
+    loki_markdown_cache_note_delete(&ctx->model, at);
+    wrap_note_delete(ctx->model.wrap, at);
+    columns_note_delete(ctx->model.columns, at);
+    editor_snapshot_note_change(&ctx->model);
+    if (at < ctx->model.numrows)
+        syntax_invalidate_row(ctx, ctx->model.row+at);
     ctx->model.dirty++;
 }
 
-/* Turn the editor rows into a single heap-allocated string.
- * Returns the pointer to the heap-allocated string and populate the
- * integer pointed by 'buflen' with the size of the string, excluding
- * the final nulterm. */
-char *editor_rows_to_string(editor_ctx_t *ctx, int *buflen) {
-    char *buf = NULL, *p;
-    int totlen = 0;
-    int j;
-
-    /* Compute count of bytes */
-    for (j = 0; j < ctx->model.numrows; j++)
-        totlen += ctx->model.row[j].size+1; /* +1 is for "\n" at end of every row */
-    *buflen = totlen;
-    totlen++; /* Also make space for nulterm */
-
-    p = buf = malloc(totlen);
-    if (buf == NULL) return NULL;
-    for (j = 0; j < ctx->model.numrows; j++) {
-        memcpy(p,ctx->model.row[j].chars,ctx->model.row[j].size);
-        p += ctx->model.row[j].size;
-        *p = '\n';
-        p++;
-    }
-    *p = '\0';
-    return buf;
+/* Remove 'n' rows from 'at' with one move of the rows below them. */
+void editor_del_rows(editor_ctx_t *ctx, int at, int n) {
+    if (at < 0 || at >= ctx->model.numrows || n <= 0) return;
+    if (n > ctx->model.numrows - at) n = ctx->model.numrows - at;
+    model_will_change(&ctx->model);
+    uint32_t bytes = 0;
+    for (int j = at; j < at + n; j++) bytes += (uint32_t)ctx->model.row[j].size + 1;
+    note_edit(ctx, at, 0, bytes, 0, -n);
+    for (int j = at; j < at + n; j++) editor_free_row(&ctx->model, ctx->model.row+j);
+    memmove(ctx->model.row+at,ctx->model.row+at+n,sizeof(ctx->model.row[0])*(ctx->model.numrows-at-n));
+    ctx->model.numrows -= n;
+    editor_model_damage_shift(&ctx->model, at);
+    for (int j = 0; j < n; j++) {
+        search_index_note_delete(&ctx->model, at);
+        loki_markdown_cache_note_delete(&ctx->model, at);
+    }
+    wrap_note_delete_rows(ctx->model.wrap, at, n);
+    columns_note_delete_rows(ctx->model.columns, at, n);
+    editor_snapshot_note_change(&ctx->model);
+    if (at < ctx->model.numrows)
+        syntax_invalidate_row(ctx, ctx->model.row+at);
+    ctx->model.dirty++;
+}
+
+static const char export_newline[] = "\n";
+
+size_t editor_model_export_size(const EditorModel *model, int flags) {
+    size_t total = 0;
+    for (int j = 0; j < model->numrows; j++)
+        total += (size_t)model->row[j].size;
+    if (flags & EXPORT_NEWLINES) total += (size_t)model->numrows;
+    return total;
+}
+
+int editor_model_export(const EditorModel *model, int flags,
+                        editor_span_fn fn, void *arg) {
+    for (int j = 0; j < model->numrows; j++) {
+        const t_erow *row = &model->row[j];
+        int ret;
+
+        if (row->size > 0) {
+            ret = fn(row->chars, (size_t)row->size, arg);
+            if (ret) return ret;
+        }
+        if (flags & EXPORT_NEWLINES) {
+            ret = fn(export_newline, 1, arg);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+const char *editor_model_read_at(const EditorModel *model, int row, int col,
+                                 int flags, size_t *len) {
+    if (row < 0 || row >= model->numrows || col < 0) {
+        *len = 0;
+        return "";
+    }
+    const t_erow *r = &model->row[row];
+    if (col < r->size) {
+        *len = (size_t)(r->size - col);
+        return r->chars + col;
+    }
+    if (col == r->size && (flags & EXPORT_NEWLINES)) {
+        *len = 1;
+        return export_newline;
+    }
+    *len = 0;
+    return "";
 }
 
 /* Insert a character at the specified position in a row, moving the remaining
  * chars on the right if needed. */
 void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c) {
     if (!row) return;
-    char *new_chars;
+    model_will_change(&ctx->model);
+    int from = at > row->size ? row->size : at;
+    note_edit(ctx, editor_row_index(ctx, row), from, 0,
+              (uint32_t)(at - from) + 1, 0);
     if (at > row->size) {
         /* Pad the string with spaces if the insert location is outside the
          * current length by more than a single character. */
         int padlen = at-row->size;
         /* In the next line +2 means: new char and null term. */
-        new_chars = realloc(row->chars,row->size+padlen+2);
-        if (new_chars == NULL) {
-            perror("Out of memory");
-            exit(1);
-        }
-        row->chars = new_chars;
+        editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                           (size_t)row->size+padlen+2,
+                           &ctx->model.alloc_stats.chars);
         memset(row->chars+row->size,' ',padlen);
         row->chars[row->size+padlen+1] = '\0';
         row->size += padlen+1;
     } else {
         /* If we are in the middle of the string just make space for 1 new
          * char plus the (already existing) null term. */
-        new_chars = realloc(row->chars,row->size+2);
-        if (new_chars == NULL) {
-            perror("Out of memory");
-            exit(1);
-        }
-        row->chars = new_chars;
+        editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                           (size_t)row->size+2,
+                           &ctx->model.alloc_stats.chars);
         memmove(row->chars+at+1,row->chars+at,row->size-at+1);
         row->size++;
     }
     row->chars[at] = c;
-    editor_update_row(ctx, row);
+    update_row_from(ctx, row, at);
     ctx->model.dirty++;
 }
 
 /* Append the string 's' at the end of a row */
 void editor_row_append_string(editor_ctx_t *ctx, t_erow *row, char *s, size_t len) {
-    char *new_chars = realloc(row->chars,row->size+len+1);
-    if (new_chars == NULL) {
-        perror("Out of memory");
-        exit(1);
-    }
-    row->chars = new_chars;
+    model_will_change(&ctx->model);
+    note_edit(ctx, editor_row_index(ctx, row), row->size, 0, (uint32_t)len, 0);
+    editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                       (size_t)row->size+len+1,
+                       &ctx->model.alloc_stats.chars);
     memcpy(row->chars+row->size,s,len);
+    int at = row->size;
     row->size += len;
     row->chars[row->size] = '\0';
-    editor_update_row(ctx, row);
+    update_row_from(ctx, row, at);
+    ctx->model.dirty++;
+}
+
+/* Replace the contents of a row with the 'len' bytes at 's'. */
+void editor_row_set(editor_ctx_t *ctx, t_erow *row, const char *s, size_t len) {
+    model_will_change(&ctx->model);
+    note_edit(ctx, editor_row_index(ctx, row), 0, (uint32_t)row->size,
+              (uint32_t)len, 0);
+    /* Shared contents are replaced, not copied ('s' may be in them) */
+    RowShare *share = row->share ? row_unshare(row) : NULL;
+    editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS, len + 1,
+                       &ctx->model.alloc_stats.chars);
+    if (len) memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->size = (int)len;
+    editor_row_share_release(share);
+    update_row_from(ctx, row, 0);
+    ctx->model.dirty++;
+}
+
+void editor_row_set_shared(editor_ctx_t *ctx, t_erow *row, RowShare *share) {
+    model_will_change(&ctx->model);
+    note_edit(ctx, editor_row_index(ctx, row), 0, (uint32_t)row->size,
+              (uint32_t)share->len, 0);
+    share->refs++;
+    if (row->share) {
+        editor_row_share_release(row_unshare(row));
+    } else {
+        row_buf_free(&ctx->model, row, ROW_BUF_CHARS, row->chars, row->chars_cap);
+        row->arena_bufs &= ~(ROW_BUF_CHARS | ROW_BUF_MAPPED);
+    }
+    row->chars = share->chars;
+    row->chars_cap = share->cap;
+    row->share = share;
+    row->size = share->len;
+    update_row_from(ctx, row, 0);
     ctx->model.dirty++;
 }
 
 /* Delete the character at offset 'at' from the specified row. */
 void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at) {
     if (row->size <= at) return;
-    /* Include null terminator in move (+1 for the null byte) */
-    memmove(row->chars+at,row->chars+at+1,row->size-at+1);
+    model_will_change(&ctx->model);
+    note_edit(ctx, editor_row_index(ctx, row), at, 1, 0, 0);
+    editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS, (size_t)row->size + 1,
+                       &ctx->model.alloc_stats.chars);
+    /* chars[at+1..size]: the rest of the row and its null terminator */
+    memmove(row->chars+at,row->chars+at+1,row->size-at);
     row->size--;
-    editor_update_row(ctx, row);
+    update_row_from(ctx, row, at);
     ctx->model.dirty++;
 }
 
+int editor_refuse_edit(editor_ctx_t *ctx) {
+    if (lazy_is_hex(&ctx->model)) {
+        editor_set_status_msg(ctx, "Hex view: type over the bytes; none can be added or removed");
+        return 1;
+    }
+    if (ctx->model.lazy) {
+        editor_set_status_msg(ctx, "Read-only: the file is too large to edit");
+        return 1;
+    }
+    if (ctx->model.follow) {
+        editor_set_status_msg(ctx, "Read-only while following the file (:follow off)");
+        return 1;
+    }
+    if (ctx->model.filter) {
+        editor_set_status_msg(ctx, "Read-only while filtering through a command (:! stops it)");
+        return 1;
+    }
+    return 0;
+}
+
 /* Insert the specified char at the current prompt position. */
 void editor_insert_char(editor_ctx_t *ctx, int c) {
+    if (lazy_overwrite(ctx, c)) return;
+    if (editor_refuse_edit(ctx)) return;
     int filerow = ctx->view.rowoff+ctx->view.cy;
     int filecol = ctx->view.coloff+ctx->view.cx;
     t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
@@ -388,6 +1402,7 @@ void editor_insert_char(editor_ctx_t *ctx, int c) {
 /* Inserting a newline is slightly complex as we have to handle inserting a
  * newline in the middle of a line, splitting the line as needed. */
 void editor_insert_newline(editor_ctx_t *ctx) {
+    if (editor_refuse_edit(ctx)) return;
     int filerow = ctx->view.rowoff+ctx->view.cy;
     int filecol = ctx->view.coloff+ctx->view.cx;
     t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
@@ -395,7 +1410,9 @@ void editor_insert_newline(editor_ctx_t *ctx) {
     if (!row) {
         if (filerow == ctx->model.numrows) {
             editor_insert_row(ctx, filerow,"",0);
-            undo_record_insert_line(ctx, filerow, filecol, "", 0);
+            /* Recorded as splitting the row above at its end */
+            if (filerow > 0)
+                undo_record_insert_line(ctx, filerow - 1, ctx->model.row[filerow-1].size, "", 0);
             goto fixcursor;
         }
         return;
@@ -405,7 +1422,9 @@ void editor_insert_newline(editor_ctx_t *ctx) {
     if (filecol >= row->size) filecol = row->size;
     if (filecol == 0) {
         editor_insert_row(ctx, filerow,"",0);
-        undo_record_insert_line(ctx, filerow, filecol, "", 0);
+        /* Recorded as splitting the row at its start */
+        row = &ctx->model.row[filerow+1];
+        undo_record_insert_line(ctx, filerow, 0, row->chars, row->size);
     } else {
         /* We are in the middle of a line. Split it between two rows. */
         char *split_content = row->chars + filecol;
@@ -413,9 +1432,12 @@ void editor_insert_newline(editor_ctx_t *ctx) {
         editor_insert_row(ctx, filerow+1, split_content, split_length);
         undo_record_insert_line(ctx, filerow, filecol, split_content, split_length);
         row = &ctx->model.row[filerow];
+        note_edit(ctx, filerow, filecol, (uint32_t)split_length, 0, 0);
+        editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                           (size_t)row->size + 1, &ctx->model.alloc_stats.chars);
         row->chars[filecol] = '\0';
         row->size = filecol;
-        editor_update_row(ctx, row);
+        update_row_from(ctx, row, filecol);
     }
 fixcursor:
     if (ctx->view.cy == ctx->view.screenrows-1) {
@@ -423,15 +1445,259 @@ fixcursor:
     } else {
         ctx->view.cy++;
     }
-    ctx->view.cx = 0;
-    ctx->view.coloff = 0;
+    ctx->view.cx = 0;
+    ctx->view.coloff = 0;
+
+    /* Apply auto-indentation */
+    indent_apply(ctx);
+}
+
+/* Put the cursor at document position (row, col), scrolling the view to
+ * it if needed. */
+void editor_cursor_to(editor_ctx_t *ctx, int row, int col) {
+    editor_scroll_to_row(ctx, row);
+    ctx->view.cx = col - ctx->view.coloff;
+    if (ctx->view.cx < 0) {
+        ctx->view.coloff = col;
+        ctx->view.cx = 0;
+    } else if (ctx->view.cx >= ctx->view.screencols && ctx->view.screencols > 0) {
+        ctx->view.coloff = col - ctx->view.screencols + 1;
+        ctx->view.cx = ctx->view.screencols - 1;
+    }
+}
+
+int editor_text_cols(editor_ctx_t *ctx) {
+    int cols = ctx->view.screencols - editor_gutter_width(ctx);
+    return cols < 1 ? 1 : cols;
+}
+
+/* With word wrap on, rows are wrapped but for long ones, which scroll
+ * through their window as before */
+static int row_wraps(const editor_ctx_t *ctx, const t_erow *row) {
+    return ctx->view.word_wrap && row->size < ROW_LONG_MIN;
+}
+
+/* Screen rows 'filerow' takes at 'cols' cells, the render column each
+ * starts at and, if 'widths' is not NULL, the cells on each (see
+ * wrap_row()) */
+static int row_height(editor_ctx_t *ctx, int filerow, int cols,
+                      const int **starts, const int **widths) {
+    static int first[2];
+    EditorModel *model = &ctx->model;
+    t_erow *row = &model->row[filerow];
+    const int *w;
+    first[1] = cols;
+    *starts = &first[0];
+    if (widths) *widths = &first[1];
+    if (!row_wraps(ctx, row)) return 1;
+    if (model->wrap == NULL && (model->wrap = wrap_cache_new()) == NULL)
+        return 1;
+    return wrap_row(model->wrap, filerow, row->chars, row->size, cols, starts,
+                    widths ? widths : &w);
+}
+
+/* Screen row of the wrapped row 'filerow' the cursor is on, and its
+ * column there */
+static int cursor_segment(editor_ctx_t *ctx, int filerow, int cols, int *col) {
+    const int *starts;
+    int h = row_height(ctx, filerow, cols, &starts, NULL);
+    t_erow *row = &ctx->model.row[filerow];
+    int rc = editor_row_cx_to_rx(row, ctx->view.coloff + ctx->view.cx);
+    int s = 0;
+    while (s + 1 < h && starts[s + 1] <= rc) s++;
+    if (col) *col = editor_row_cells(&ctx->model, row, starts[s], rc);
+    return s;
+}
+
+void editor_scroll_to_row(editor_ctx_t *ctx, int row) {
+    FoldSet *folds = ctx->model.folds;
+    row = fold_head(folds, row);
+    ctx->view.rowoff = fold_head(folds, ctx->view.rowoff);
+    if (row < ctx->view.rowoff) {
+        ctx->view.rowoff = row;
+    } else if (ctx->view.screenrows > 0) {
+        int screen = fold_screen_row(folds, row);
+        if (screen - fold_screen_row(folds, ctx->view.rowoff) >= ctx->view.screenrows)
+            ctx->view.rowoff = fold_row(folds, screen - ctx->view.screenrows + 1);
+    }
+
+    /* Wrapped rows take more than one screen row: scroll on until the
+     * rows down to this one fit, or it is the top one. At most a screen
+     * of rows is looked at. */
+    if (ctx->view.word_wrap && ctx->view.screenrows > 0 &&
+        row < ctx->model.numrows) {
+        int cols = editor_text_cols(ctx), used = 0;
+        const int *starts;
+        for (int r = ctx->view.rowoff; r <= row; r = fold_next(folds, r))
+            used += row_height(ctx, r, cols, &starts, NULL);
+        while (used > ctx->view.screenrows && ctx->view.rowoff < row) {
+            used -= row_height(ctx, ctx->view.rowoff, cols, &starts, NULL);
+            ctx->view.rowoff = fold_next(folds, ctx->view.rowoff);
+        }
+    }
+    ctx->view.cy = row - ctx->view.rowoff;
+}
+
+void editor_view_fix(editor_ctx_t *ctx) {
+    if (fold_count(ctx->model.folds) == 0 && !ctx->view.word_wrap) return;
+    int filerow = ctx->view.rowoff + ctx->view.cy;
+    if (ctx->view.coloff > 0 && filerow < ctx->model.numrows &&
+        row_wraps(ctx, &ctx->model.row[filerow])) {
+        ctx->view.cx += ctx->view.coloff;
+        ctx->view.coloff = 0;
+    }
+    editor_scroll_to_row(ctx, filerow);
+}
+
+const ScreenLine *editor_screen_lines(editor_ctx_t *ctx, int count, int *n,
+                                      int *wrapped) {
+    static ScreenLine *lines = NULL;    /* Reused across frames */
+    static int cap = 0;
+    if (count > cap) {
+        ScreenLine *p = realloc(lines, sizeof(ScreenLine) * (size_t)count);
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        lines = p;
+        cap = count;
+    }
+
+    FoldSet *folds = ctx->model.folds;
+    int cols = editor_text_cols(ctx);
+    int k = 0;
+    *wrapped = 0;
+    for (int row = fold_head(folds, ctx->view.rowoff);
+         k < count && row < ctx->model.numrows; row = fold_next(folds, row)) {
+        if (!row_wraps(ctx, &ctx->model.row[row])) {
+            lines[k++] = (ScreenLine){ row, -1, cols };
+            continue;
+        }
+        const int *starts, *widths;
+        int h = row_height(ctx, row, cols, &starts, &widths);
+        if (h > 1) *wrapped = 1;
+        for (int i = 0; i < h && k < count; i++)
+            lines[k++] = (ScreenLine){ row, starts[i], widths[i] };
+    }
+    *n = k;
+
+    /* Bring each run of consecutive rows up to date; the rows a closed
+     * fold hides are skipped */
+    int pending = 0;
+    for (int i = 0; i < k; ) {
+        int j = i + 1;
+        while (j < k && (lines[j].row == lines[j - 1].row ||
+                         lines[j].row == lines[j - 1].row + 1)) j++;
+        syntax_fresh_rows(ctx, lines[i].row, lines[j - 1].row + 1);
+        pending |= ctx->model.hl_pending;
+        i = j;
+    }
+    ctx->model.hl_pending = pending;
+    return lines;
+}
+
+int editor_cursor_screen_row(editor_ctx_t *ctx) {
+    FoldSet *folds = ctx->model.folds;
+    int filerow = ctx->view.rowoff + ctx->view.cy;
+    if (!ctx->view.word_wrap) {
+        if (!folds) return ctx->view.cy;
+        return fold_screen_row(folds, filerow) -
+               fold_screen_row(folds, ctx->view.rowoff);
+    }
+
+    int cols = editor_text_cols(ctx), y = 0;
+    const int *starts;
+    for (int row = fold_head(folds, ctx->view.rowoff);
+         row < filerow && row < ctx->model.numrows &&
+         y < ctx->view.screenrows; row = fold_next(folds, row))
+        y += row_height(ctx, row, cols, &starts, NULL);
+    if (filerow < ctx->model.numrows)
+        y += cursor_segment(ctx, filerow, cols, NULL);
+    if (ctx->view.screenrows > 0 && y >= ctx->view.screenrows)
+        y = ctx->view.screenrows - 1;
+    return y;
+}
+
+/* Is 'row' drawn in column mode? Long rows are drawn as they are. */
+static int row_in_columns(const EditorModel *model, const t_erow *row) {
+    return model->columns && row->size < ROW_LONG_MIN;
+}
+
+/* Column mode: the display column of the cursor, or -1 if its row is not
+ * drawn in columns */
+static int column_cursor_col(editor_ctx_t *ctx) {
+    int filerow = ctx->view.rowoff + ctx->view.cy;
+    if (filerow >= ctx->model.numrows) return -1;
+    t_erow *row = &ctx->model.row[filerow];
+    if (!row_in_columns(&ctx->model, row)) return -1;
+    const ColumnField *fields;
+    int n = columns_layout(ctx->model.columns, filerow, row->chars, row->size,
+                           &fields);
+    int at = ctx->view.coloff + ctx->view.cx;
+    return columns_display_col(fields, n, row->chars, at < row->size ? at : row->size);
+}
+
+/* Column mode: the display column the text area starts at, as far right
+ * as the cursor needs to show */
+static int column_view_off(editor_ctx_t *ctx) {
+    int col = column_cursor_col(ctx), cols = editor_text_cols(ctx);
+    return col >= cols ? col - cols + 1 : 0;
+}
+
+int editor_cursor_screen_col(editor_ctx_t *ctx) {
+    int filerow = ctx->view.rowoff + ctx->view.cy;
+    if (filerow >= ctx->model.numrows) return 0;
+    t_erow *row = &ctx->model.row[filerow];
+    if (row_wraps(ctx, row)) {
+        int col;
+        cursor_segment(ctx, filerow, editor_text_cols(ctx), &col);
+        return col;
+    }
+
+    int col = column_cursor_col(ctx);
+    if (col >= 0) {
+        int cols = editor_text_cols(ctx);
+        return col >= cols ? cols - 1 : col;
+    }
 
-    /* Apply auto-indentation */
-    indent_apply(ctx);
+    int rc = editor_row_cx_to_rx(row, ctx->view.coloff + ctx->view.cx);
+    return editor_row_cells(&ctx->model, row, ctx->view.coloff, rc);
+}
+
+int editor_screen_row_to_row(editor_ctx_t *ctx, int y, int *start) {
+    FoldSet *folds = ctx->model.folds;
+    if (start) *start = -1;
+    if (!ctx->view.word_wrap)
+        return fold_row(folds, fold_screen_row(folds, ctx->view.rowoff) + y);
+
+    int cols = editor_text_cols(ctx);
+    int row = fold_head(folds, ctx->view.rowoff);
+    for (; row < ctx->model.numrows; row = fold_next(folds, row)) {
+        const int *starts;
+        int h = row_height(ctx, row, cols, &starts, NULL);
+        if (y < h) {
+            if (start && row_wraps(ctx, &ctx->model.row[row]))
+                *start = starts[y];
+            return row;
+        }
+        y -= h;
+    }
+    return row + y;
+}
+
+/* Insert text, newlines and all, at the current prompt position as one
+ * edit (see editor_replace_range()), leaving the cursor after it. No
+ * auto-indentation: the text goes in as it is. */
+void editor_insert_text(editor_ctx_t *ctx, const char *text, size_t len) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    editor_replace_range(ctx, row, col, row, col, text, len, &row, &col);
+    editor_cursor_to(ctx, row, col);
 }
 
 /* Delete the char at the current prompt position. */
 void editor_del_char(editor_ctx_t *ctx) {
+    if (editor_refuse_edit(ctx)) return;
     int filerow = ctx->view.rowoff+ctx->view.cy;
     int filecol = ctx->view.coloff+ctx->view.cx;
     t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
@@ -466,15 +1732,427 @@ void editor_del_char(editor_ctx_t *ctx) {
         else
             ctx->view.cx--;
     }
-    if (row) editor_update_row(ctx, row);
+    if (row) update_row_from(ctx, row, 0);
     /* Note: dirty already incremented by editor_row_del_char or editor_del_row */
 }
 
-/* Load the specified program in the editor memory and returns 0 on success
- * or -1 on error. */
-int editor_open(editor_ctx_t *ctx, char *filename) {
-    FILE *fp;
+/* ============================ Range edits =============================== */
+
+/* The text from (row, col) up to (end_row, end_col), rows joined by
+ * newlines. Positions must be valid, the start first. Returns a malloc'ed
+ * string of *len bytes. */
+static char *range_text(editor_ctx_t *ctx, int row, int col, int end_row,
+                        int end_col, int *len) {
+    size_t size = 0;
+    for (int r = row; r <= end_row; r++) size += (size_t)ctx->model.row[r].size + 1;
+    char *text = malloc(size + 1);
+    if (text == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    size_t n = 0;
+    for (int r = row; r <= end_row; r++) {
+        const t_erow *er = &ctx->model.row[r];
+        int from = r == row ? col : 0;
+        int to = r == end_row ? end_col : er->size;
+        memcpy(text + n, er->chars + from, (size_t)(to - from));
+        n += (size_t)(to - from);
+        if (r < end_row) text[n++] = '\n';
+    }
+    text[n] = '\0';
+    *len = (int)n;
+    return text;
+}
+
+/* Put 'len' bytes at 's' at 'col' of a row, after its first 'col' bytes,
+ * followed by the 'tail_len' bytes at 'tail'. */
+static void set_row_from(editor_ctx_t *ctx, t_erow *row, int col,
+                         const char *s, size_t len, const char *tail,
+                         size_t tail_len) {
+    editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                       (size_t)col + len + tail_len + 1,
+                       &ctx->model.alloc_stats.chars);
+    if (len) memcpy(row->chars + col, s, len);
+    if (tail_len) memcpy(row->chars + col + len, tail, tail_len);
+    row->size = col + (int)(len + tail_len);
+    row->chars[row->size] = '\0';
+    update_row_from(ctx, row, col);
+}
+
+/* Tell the decorations, marks, folds, parse tree and watches that the 'old_len'
+ * bytes from (row, col) to (end_row, end_col) became the 'len' bytes up
+ * to (new_row, new_col) */
+static void note_range_edit(editor_ctx_t *ctx, int row, int col, int end_row,
+                            int end_col, int new_row, int new_col, int old_len,
+                            size_t len) {
+    EditorModel *model = &ctx->model;
+    if (model->counts_kept) model->count_bytes += (long long)len - old_len;
+    decor_note_edit(model->decor, row, col, end_row, end_col, new_row, new_col);
+    diffview_note_edit(model, row, end_row, new_row);
+    lsp_note_edit(model, row, end_row, new_row);
+    changes_note_edit(model, row, end_row, new_row);
+    marks_note_edit(model->marks, row, col, end_row, end_col, new_row, new_col);
+    fold_note_edit(model->folds, row, col, end_row, end_col, new_row, new_col);
+#ifdef LOKI_USE_LINENOISE
+    if (model->ts_state) {
+        TSPoint start = { (uint32_t)row, (uint32_t)col };
+        TSPoint old_end = { (uint32_t)end_row, (uint32_t)end_col };
+        TSPoint new_end = { (uint32_t)new_row, (uint32_t)new_col };
+        treesitter_note_edit(model->ts_state, model, start, old_end,
+                             (uint32_t)old_len, new_end, (uint32_t)len);
+    }
+#endif
+}
+
+int editor_replace_range(editor_ctx_t *ctx, int row, int col, int end_row,
+                         int end_col, const char *text, size_t len,
+                         int *out_row, int *out_col) {
+    EditorModel *model = &ctx->model;
+    if (editor_refuse_edit(ctx)) {
+        if (out_row) *out_row = row;
+        if (out_col) *out_col = col;
+        return 0;
+    }
+    model_will_change(model);
+    if (model->numrows == 0) insert_row(ctx, 0, "", 0, 0, 0);
+
+    /* Clamp both ends to the document, then put them in order */
+    int numrows = model->numrows;
+    if (row < 0) { row = 0; col = 0; }
+    if (end_row < 0) { end_row = 0; end_col = 0; }
+    if (row >= numrows) { row = numrows - 1; col = INT_MAX; }
+    if (end_row >= numrows) { end_row = numrows - 1; end_col = INT_MAX; }
+    if (col < 0) col = 0;
+    if (end_col < 0) end_col = 0;
+    if (col > model->row[row].size) col = model->row[row].size;
+    if (end_col > model->row[end_row].size) end_col = model->row[end_row].size;
+    if (end_row < row || (end_row == row && end_col < col)) {
+        int t = row; row = end_row; end_row = t;
+        t = col; col = end_col; end_col = t;
+    }
+
+    int old_len;
+    char *old = range_text(ctx, row, col, end_row, end_col, &old_len);
+    if (len == 0 && old_len == 0) {
+        free(old);
+        if (out_row) *out_row = row;
+        if (out_col) *out_col = col;
+        return 0;
+    }
+
+    /* The inserted lines: the first goes after the prefix of 'row', the
+     * last before the rest of 'end_row' */
+    int lines = 1;
+    for (size_t i = 0; i < len; i++) if (text[i] == '\n') lines++;
+    const char *last_line = text;
+    for (const char *p = text; p < text + len; p++)
+        if (*p == '\n') last_line = p + 1;
+    int last_len = (int)(text + len - last_line);
+    int new_end_col = lines == 1 ? col + (int)len : last_len;
+
+    note_range_edit(ctx, row, col, end_row, end_col, row + lines - 1,
+                    new_end_col, old_len, len);
+
+    t_erow *er = &model->row[end_row];
+    int tail_len = er->size - end_col;
+    char *tail = malloc((size_t)tail_len + 1);
+    if (tail == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(tail, er->chars + end_col, (size_t)tail_len);
+
+    /* One move of the rows below makes room for the new lines, or closes
+     * the gap the old ones leave */
+    int old_rows = end_row - row + 1, delta = lines - old_rows;
+    int below = end_row + 1;
+    if (delta > 0) {
+        model_reserve_rows(model, (size_t)model->numrows + (size_t)delta);
+        memmove(model->row + below + delta, model->row + below,
+                sizeof(model->row[0]) * (size_t)(model->numrows - below));
+        for (int i = 0; i < delta; i++) {
+            init_row(model, model->row + below + i, "", 0, 0);
+            search_index_note_insert(model, below + i);
+            loki_markdown_cache_note_insert(model, below + i);
+            wrap_note_insert(model->wrap, below + i);
+            columns_note_insert(model->columns, below + i);
+        }
+    } else if (delta < 0) {
+        for (int r = row + lines; r < below; r++)
+            editor_free_row(model, model->row + r);
+        memmove(model->row + row + lines, model->row + below,
+                sizeof(model->row[0]) * (size_t)(model->numrows - below));
+        for (int i = 0; i < -delta; i++) {
+            search_index_note_delete(model, row + lines);
+            loki_markdown_cache_note_delete(model, row + lines);
+            wrap_note_delete(model->wrap, row + lines);
+            columns_note_delete(model->columns, row + lines);
+        }
+    }
+    model->numrows += delta;
+    if (delta) {
+        editor_model_damage_shift(model, row);
+        editor_snapshot_note_change(model);
+    }
+
+    /* Fill in the lines */
+    const char *p = text;
+    for (int i = 0; i < lines; i++) {
+        const char *nl = i < lines - 1 ? memchr(p, '\n', len - (size_t)(p - text))
+                                       : text + len;
+        int last = i == lines - 1;
+        set_row_from(ctx, model->row + row + i, i == 0 ? col : 0, p,
+                     (size_t)(nl - p), last ? tail : NULL,
+                     last ? (size_t)tail_len : 0);
+        p = nl + 1;
+    }
+    /* The row below now follows different lines */
+    if (row + lines < model->numrows)
+        syntax_invalidate_row(ctx, model->row + row + lines);
+    free(tail);
+
+    undo_record_replace_range(ctx, row, col, old, old_len, text, (int)len);
+    free(old);
+    model->dirty++;
+    if (out_row) *out_row = row + lines - 1;
+    if (out_col) *out_col = new_end_col;
+    return old_len;
+}
+
+int editor_permute_rows(editor_ctx_t *ctx, int first, int last,
+                        const int *order, int count) {
+    EditorModel *model = &ctx->model;
+    if (editor_refuse_edit(ctx)) return 0;
+    if (first < 0 || first > last || last >= model->numrows ||
+        count < 1 || count > last - first + 1)
+        return 0;
+    model_will_change(model);
+
+    /* The text before and after, for undo (and its replay of the edit) */
+    int old_len;
+    char *old = range_text(ctx, first, 0, last, model->row[last].size, &old_len);
+    size_t len = 0;
+    for (int i = 0; i < count; i++) len += (size_t)model->row[first + order[i]].size + 1;
+    char *text = malloc(len);
+    t_erow *moved = malloc(sizeof(t_erow) * (size_t)count);
+    unsigned char *kept = calloc((size_t)(last - first + 1), 1);
+    if (text == NULL || moved == NULL || kept == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    len = 0;
+    for (int i = 0; i < count; i++) {
+        const t_erow *er = &model->row[first + order[i]];
+        memcpy(text + len, er->chars, (size_t)er->size);
+        len += (size_t)er->size;
+        if (i < count - 1) text[len++] = '\n';
+    }
+    int new_end_col = model->row[first + order[count - 1]].size;
+    note_range_edit(ctx, first, 0, last, model->row[last].size,
+                    first + count - 1, new_end_col, old_len, len);
+
+    /* The rows themselves move: their text, rendering and allocations go
+     * with them, and those left out are freed */
+    for (int i = 0; i < count; i++) {
+        moved[i] = model->row[first + order[i]];
+        kept[order[i]] = 1;
+    }
+    for (int r = first; r <= last; r++)
+        if (!kept[r - first]) editor_free_row(model, model->row + r);
+    memcpy(model->row + first, moved, sizeof(t_erow) * (size_t)count);
+    int gone = last - first + 1 - count;
+    if (gone > 0) {
+        memmove(model->row + first + count, model->row + last + 1,
+                sizeof(model->row[0]) * (size_t)(model->numrows - last - 1));
+        for (int i = 0; i < gone; i++) {
+            search_index_note_delete(model, first + count);
+            loki_markdown_cache_note_delete(model, first + count);
+            wrap_note_delete(model->wrap, first + count);
+            columns_note_delete(model->columns, first + count);
+        }
+        model->numrows -= gone;
+        editor_model_damage_shift(model, first);
+    }
+    for (int r = first; r < first + count; r++)
+        update_row_from(ctx, model->row + r, 0);
+    if (first + count < model->numrows)
+        syntax_invalidate_row(ctx, model->row + first + count);
+    free(kept);
+    free(moved);
+
+    undo_record_replace_range(ctx, first, 0, old, old_len, text, (int)len);
+    free(old);
+    free(text);
+    model->dirty++;
+    return count;
+}
+
+int editor_delete_range(editor_ctx_t *ctx, int row, int col, int end_row,
+                        int end_col, int *out_row, int *out_col) {
+    return editor_replace_range(ctx, row, col, end_row, end_col, "", 0,
+                                out_row, out_col);
+}
+
+/* ======================= Parallel row construction ====================== */
+
+/* Files with at least this many lines have their rows built and highlighted
+ * on worker threads. Below it, thread start-up costs more than it saves. */
+#define OPEN_PARALLEL_MIN_ROWS 16384
+
+/* Rows claimed by a worker at a time. */
+#define OPEN_PARALLEL_CHUNK_ROWS 4096
+
+/* Upper bound on worker threads. */
+#define OPEN_PARALLEL_MAX_WORKERS 64
+
+/* Shared state for one parallel open. Workers claim chunks of the line index
+ * under 'lock' and fill model.row[base + i] for every line i in the chunk. */
+typedef struct open_job {
+    editor_ctx_t *ctx;
+    const LoadedFile *file;
+    const LineIndex *index;
+    int base;           /* First model row filled by this job */
+    int view;           /* file is model.row_map: use lines where they are */
+    int nchunks;        /* Number of OPEN_PARALLEL_CHUNK_ROWS chunks */
+    int next_chunk;     /* Next unclaimed chunk (guarded by lock) */
+    uv_mutex_t lock;
+} open_job;
+
+/* Whether line 'i' of a file kept as model.row_map can be used where it is
+ * (view_row()). Writing its NUL gives the page it goes to a copy of its own,
+ * which keeps a line within that page from following later changes to the
+ * file on disk, as a line across pages would; and a file ending on a page
+ * boundary has no room for the NUL of its last line. */
+static int line_viewable(const LoadedFile *file, const LineIndex *index, int i) {
+    size_t start = index->start[i];
+    size_t end = start + (size_t)index->len[i];
+    if (end == file->size && file->size % view_page == 0) return 0;
+    return start / view_page == end / view_page;
+}
+
+static void open_worker(void *arg) {
+    open_job *job = arg;
+    editor_ctx_t *ctx = job->ctx;
+    EditorAllocStats stats = {0, 0, 0, 0};
+
+    for (;;) {
+        uv_mutex_lock(&job->lock);
+        int chunk = job->next_chunk++;
+        uv_mutex_unlock(&job->lock);
+        if (chunk >= job->nchunks) break;
+
+        int first = chunk * OPEN_PARALLEL_CHUNK_ROWS;
+        int last = first + OPEN_PARALLEL_CHUNK_ROWS;
+        if (last > job->index->count) last = job->index->count;
+
+        for (int i = first; i < last; i++) {
+            t_erow *row = &ctx->model.row[job->base + i];
+            int len = job->index->len[i];
+
+            memset(row, 0, sizeof(*row));
+            row->size = len;
+            row->cb_lang = CB_LANG_NONE;
+            row->edit_gen = ctx->model.edit_gen;
+            if (job->view && line_viewable(job->file, job->index, i)) {
+                view_row(row, (char *)job->file->data + job->index->start[i],
+                         (size_t)len);
+            } else {
+                editor_row_reserve(&ctx->model, row, ROW_BUF_CHARS,
+                                   (size_t)len + 1, &stats.chars);
+                memcpy(row->chars, job->file->data + job->index->start[i], len);
+                row->chars[len] = '\0';
+            }
+            if (job->index->tabs[i] > 0 && render_on_demand && len < ROW_LONG_MIN) {
+                row->hl_stale = 1;  /* Rendered when first read */
+                continue;
+            }
+            build_row_render(&ctx->model, row, (unsigned int)job->index->tabs[i],
+                             &stats);
+        }
+        syntax_update_rows(ctx, job->base + first, job->base + last, &stats);
+    }
+
+    /* Fold this worker's allocation counts into the model's. */
+    uv_mutex_lock(&job->lock);
+    ctx->model.alloc_stats.chars += stats.chars;
+    ctx->model.alloc_stats.render += stats.render;
+    ctx->model.alloc_stats.hl += stats.hl;
+    uv_mutex_unlock(&job->lock);
+}
+
+/* Append every indexed line to the model using a pool of threads.
+ * Each chunk is highlighted assuming no comment is open when it starts;
+ * a sequential fix-up then marks any chunk boundary where that was wrong
+ * as stale, so it is re-highlighted when first read. Returns 0 on success, or -1 if the file is too small or
+ * the highlighter is not thread-safe, in which case nothing was changed. */
+static int open_rows_parallel(editor_ctx_t *ctx, const LoadedFile *file,
+                              const LineIndex *index, int view) {
+    if (index->count < OPEN_PARALLEL_MIN_ROWS) return -1;
+    if (!syntax_rows_thread_safe(ctx)) return -1;
+    if ((size_t)ctx->model.numrows + index->count >= SIZE_MAX / sizeof(t_erow) ||
+        ctx->model.numrows > INT_MAX - index->count) return -1;
+
+    open_job job;
+    job.ctx = ctx;
+    job.file = file;
+    job.index = index;
+    job.base = ctx->model.numrows;
+    job.view = view;
+    job.nchunks = (index->count + OPEN_PARALLEL_CHUNK_ROWS - 1) / OPEN_PARALLEL_CHUNK_ROWS;
+    job.next_chunk = 0;
+    if (uv_mutex_init(&job.lock) != 0) return -1;
+
+    model_reserve_rows(&ctx->model, (size_t)job.base + index->count);
+
+    int nworkers = task_pool_threads();
+    if (nworkers > job.nchunks) nworkers = job.nchunks;
+    if (nworkers > OPEN_PARALLEL_MAX_WORKERS) nworkers = OPEN_PARALLEL_MAX_WORKERS;
+
+    /* The calling thread works too, so submit one fewer helper. */
+    Task *tasks[OPEN_PARALLEL_MAX_WORKERS];
+    int started = 0;
+    while (started < nworkers - 1 &&
+           (tasks[started] = task_submit(open_worker, &job, TASK_PRIORITY_HIGH, NULL))) {
+        started++;
+    }
+    open_worker(&job);
+    for (int i = 0; i < started; i++) task_wait(tasks[i]);
+    uv_mutex_destroy(&job.lock);
+
+    ctx->model.numrows = job.base + index->count;
+    ctx->model.counts_kept = 0;
+    editor_model_damage_shift(&ctx->model, job.base);
+
+    /* Resolve multi-line comment state across chunk boundaries (and across
+     * the boundary with rows that were already in the model). */
+    for (int chunk = (job.base > 0 ? 0 : 1); chunk < job.nchunks; chunk++) {
+        int r = job.base + chunk * OPEN_PARALLEL_CHUNK_ROWS;
+        if (syntax_row_has_open_comment(&ctx->model.row[r-1]))
+            syntax_invalidate_row(ctx, &ctx->model.row[r]);
+    }
+    /* And rows left unrendered, from the first of them down */
+    for (int r = job.base; render_on_demand && r < ctx->model.numrows; r++) {
+        if (ctx->model.row[r].hl_stale) {
+            syntax_invalidate_row(ctx, &ctx->model.row[r]);
+            break;
+        }
+    }
+    return 0;
+}
 
+/* Name the buffer after the file being opened, resetting what depends on
+ * the name and the contents. */
+static void open_set_filename(editor_ctx_t *ctx, const char *filename) {
+    lazy_close(&ctx->model);
+    follow_stop(&ctx->model);
+    filter_stop(&ctx->model);
+    reload_unwatch(&ctx->model);
+    diffview_note_reset(&ctx->model);
+    lsp_note_reset(&ctx->model);
+    changes_note_reset(&ctx->model);
+    word_index_free(&ctx->model);
+    search_index_disable(&ctx->model);
+    loki_markdown_cache_free(&ctx->model);
     ctx->model.dirty = 0;
     free(ctx->model.filename);
     size_t fnlen = strlen(filename)+1;
@@ -484,145 +2162,621 @@ int editor_open(editor_ctx_t *ctx, char *filename) {
         exit(1);
     }
     memcpy(ctx->model.filename,filename,fnlen);
+    ctx->model.lang.gen = 0;  /* The new name may reuse the old address */
+    editor_view_reset_derived(&ctx->view);
+}
+
+/* editor_append_lines(), with 'view' if 'file' is model.row_map and its
+ * lines can be used where they are */
+static void append_lines(editor_ctx_t *ctx, const LoadedFile *file,
+                         const LineIndex *index, int view) {
+    int base = ctx->model.numrows;
+    if (open_rows_parallel(ctx, file, index, view) == -1) {
+        for (int i = 0; i < index->count; i++) {
+            insert_row(ctx, ctx->model.numrows, file->data + index->start[i],
+                       index->len[i], index->tabs[i],
+                       view && line_viewable(file, index, i));
+        }
+        return;
+    }
+    /* Which insert_row() notes one row at a time */
+    for (int r = base; r < ctx->model.numrows; r++) {
+        search_index_note_insert(&ctx->model, r);
+        loki_markdown_cache_note_insert(&ctx->model, r);
+    }
+    diffview_note_edit(&ctx->model, base, base, ctx->model.numrows);
+    lsp_note_edit(&ctx->model, base, base, ctx->model.numrows);
+    changes_note_edit(&ctx->model, base, base, ctx->model.numrows);
+    editor_snapshot_note_change(&ctx->model);
+}
+
+void editor_append_lines(editor_ctx_t *ctx, const LoadedFile *file,
+                         const LineIndex *index) {
+    append_lines(ctx, file, index, 0);
+}
 
-    fp = fopen(filename,"r");
-    if (!fp) {
+/* Have the model keep the mapping of the file it is being opened from, as
+ * model.row_map, so its rows can use the lines where they are and copy
+ * one only when it is first changed (editor_row_reserve()). The mapping
+ * is made writable, for the NUL each row ends with. Returns 1 if the
+ * model took it, 0 if rows should be copied from it as usual. */
+static int keep_mapping(editor_ctx_t *ctx, const LoadedFile *file) {
+    EditorModel *model = &ctx->model;
+    if (!file->mapped || model->numrows > 0 || model->row_map) return 0;
+    void *map = (void *)file->data;
+    if (mprotect(map, file->size, PROT_READ | PROT_WRITE) == -1) return 0;
+    /* Rows are read in any order from now on */
+    posix_madvise(map, file->size, POSIX_MADV_NORMAL);
+    view_page = (size_t)sysconf(_SC_PAGESIZE);
+    model->row_map = editor_row_map_new(map, file->size);
+    return 1;
+}
+
+/* Create rows from a mapped and indexed file, releasing both (or handing
+ * the mapping to the model, see keep_mapping()). */
+static int open_indexed(editor_ctx_t *ctx, LoadedFile *file, LineIndex *index,
+                        int indexed) {
+    /* Binary files are shown in hex, and files indexed anyway (as by a
+     * prefetch) with too many rows a window at a time */
+    if (index->binary || file->size >= lazy_min_bytes()) {
+        loader_index_free(index);
+        return lazy_open(ctx, file);
+    }
+
+    if (keep_mapping(ctx, file)) {
+        append_lines(ctx, file, index, 1);
+        memset(file, 0, sizeof(*file));     /* The model's now */
+    } else {
+        append_lines(ctx, file, index, 0);
+        loader_close(file);
+    }
+    loader_index_free(index);
+    ctx->model.dirty = 0;
+
+    /* Indent new lines the way the file already does */
+    indent_adopt_detected(ctx);
+
+    /* Pick up the history the file was last saved with */
+    undo_history_open(ctx);
+    /* Or unsaved changes a crash left behind */
+    recovery_opened(ctx);
+
+    /* Long buffers are indexed for searching in the background */
+    if (indexed || ctx->model.numrows >= SEARCH_INDEX_MIN_ROWS)
+        search_index_enable(&ctx->model);
+
+    /* Its words are indexed for completion in the background */
+    word_index_enable(ctx);
+
+    /* And changes made to it elsewhere are patched in */
+    reload_watch(ctx);
+    return 0;
+}
+
+/* Load the specified program in the editor memory and returns 0 on success
+ * or -1 on error. The file is mapped and indexed by loader.c, then rows are
+ * created directly from the mapping; files of lazy_min_bytes() or more
+ * are not indexed but shown a window at a time (lazy.c). Files with a NUL
+ * byte in the first 1KB are binary, and shown in hex the same way. */
+static int open_file(editor_ctx_t *ctx, char *filename) {
+    LoadedFile file;
+    LineIndex index;
+    int indexed = ctx->model.search_index != NULL;
+
+    open_set_filename(ctx, filename);
+    if (remote_is_url(filename)) return lazy_open_remote(ctx, filename);
+
+    if (loader_open(filename, &file) == -1) {
         if (errno != ENOENT) {
             perror("Opening file");
             exit(1);
         }
         return -1;
     }
+    if (file.size >= lazy_min_bytes()) return lazy_open(ctx, &file);
 
-    /* Check if file appears to be binary by looking for null bytes in first 1KB */
-    char probe[1024];
-    size_t probe_len = fread(probe, 1, sizeof(probe), fp);
-    for (size_t i = 0; i < probe_len; i++) {
-        if (probe[i] == '\0') {
-            fclose(fp);
-            editor_set_status_msg(ctx, "Cannot open binary file");
-            return -1;
-        }
+    /* One pass builds line offsets, per-line TAB counts and the binary
+     * check; rows are then created without rescanning for TABs. */
+    if (loader_index_lines(file.data, file.size, &index) == -1) {
+        loader_close(&file);
+        editor_set_status_msg(ctx, "Cannot open file: %s", strerror(errno));
+        return -1;
     }
-    rewind(fp);  /* Go back to start of file to read normally */
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line,&linecap,fp)) != -1) {
-        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-            line[--linelen] = '\0';
-        editor_insert_row(ctx, ctx->model.numrows,line,linelen);
-    }
-    free(line);
-    fclose(fp);
-    ctx->model.dirty = 0;
+    return open_indexed(ctx, &file, &index, indexed);
+}
 
+int editor_open(editor_ctx_t *ctx, char *filename) {
+    if (open_file(ctx, filename) == -1) return -1;
+    autocmd_file_read(ctx);
     return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, -1 on error. */
-int editor_save(editor_ctx_t *ctx) {
-    int len;
-    char *buf = editor_rows_to_string(ctx, &len);
-    if (buf == NULL) {
-        editor_set_status_msg(ctx, "Can't save! Out of memory");
+int editor_open_view(editor_ctx_t *ctx, char *filename) {
+    LoadedFile file;
+    open_set_filename(ctx, filename);
+    if (remote_is_url(filename)) {
+        if (lazy_open_remote(ctx, filename) == -1) return -1;
+        autocmd_file_read(ctx);
+        return 0;
+    }
+    if (loader_open(filename, &file) == -1) {
+        editor_set_status_msg(ctx, "Cannot open file: %s", strerror(errno));
         return -1;
     }
+    if (lazy_open(ctx, &file) == -1) return -1;
+    editor_set_status_msg(ctx, "View: read-only, loaded as shown");
+    autocmd_file_read(ctx);
+    return 0;
+}
+
+int editor_open_loaded(editor_ctx_t *ctx, const char *filename,
+                       LoadedFile *file, LineIndex *index) {
+    int indexed = ctx->model.search_index != NULL;
+    open_set_filename(ctx, filename);
+    if (open_indexed(ctx, file, index, indexed) == -1) return -1;
+    autocmd_file_read(ctx);
+    return 0;
+}
 
+/* Save the current file on disk. Return 0 on success, -1 on error. */
+int editor_save(editor_ctx_t *ctx) {
     /* Check if buffer has a filename */
     if (ctx->model.filename == NULL) {
-        free(buf);
         editor_set_status_msg(ctx, "No file name (use :w <filename> to save)");
         return -1;
     }
+    if (lazy_is_hex(&ctx->model)) return lazy_save(ctx);
+    if (editor_refuse_edit(ctx)) return -1;
 
-    int fd = open(ctx->model.filename,O_RDWR|O_CREAT,0644);
-    if (fd == -1) goto writeerr;
-
-    /* Use truncate + a single write(2) call in order to make saving
-     * a bit safer, under the limits of what we can do in a small editor. */
-    if (ftruncate(fd,len) == -1) goto writeerr;
-    if (write(fd,buf,len) != len) goto writeerr;
+    editor_save_wait(&ctx->model);
+    long long len = save_model(&ctx->model, ctx->model.filename, NULL, NULL);
+    if (len == -1) {
+        editor_set_status_msg(ctx, "Can't save! I/O error: %s",strerror(errno));
+        return -1;
+    }
 
-    close(fd);
-    free(buf);
     ctx->model.dirty = 0;
-    editor_set_status_msg(ctx, "%d bytes written on disk", len);
+    undo_history_saved(ctx);
+    reload_watch(ctx);
+    symbols_note_file(ctx->model.filename);
+    finder_note_file(ctx->model.filename);
+    editor_set_status_msg(ctx, "%lld bytes written on disk", len);
+    autocmd_fire(ctx, AUTOCMD_BUF_WRITE);
     return 0;
-
-writeerr:
-    free(buf);
-    if (fd != -1) close(fd);
-    editor_set_status_msg(ctx, "Can't save! I/O error: %s",strerror(errno));
-    return -1;
 }
 
 /* ============================= Terminal update ============================ */
 
 /* Screen buffer functions are now in loki_terminal.c */
 
-/* Maximum render segments per row - handles syntax changes within a line */
-#define MAX_RENDER_SEGMENTS 256
+void view_frame_capture(const editor_ctx_t *ctx, ViewFrame *frame,
+                        const void *target, int rows, int text_cols,
+                        int gutter_width) {
+    const EditorView *view = &ctx->view;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->target = target;
+    frame->rowoff = view->rowoff;
+    frame->coloff = view->coloff;
+    frame->rows = rows;
+    frame->text_cols = text_cols;
+    frame->gutter_width = gutter_width;
+    frame->gen = ctx->model.damage_gen;
+    frame->sel_active = view->sel_active;
+    if (view->sel_active) {
+        int sy = view->sel_start_y, sx = view->sel_start_x;
+        int ey = view->sel_end_y, ex = view->sel_end_x;
+        if (sy > ey || (sy == ey && sx > ex)) {
+            int tmp;
+            tmp = sy; sy = ey; ey = tmp;
+            tmp = sx; sx = ex; ex = tmp;
+        }
+        frame->sel_start_y = sy; frame->sel_start_x = sx;
+        frame->sel_end_y = ey; frame->sel_end_x = ex;
+        frame->sel_block = view->sel_block;
+    }
+    frame->fold_gen = fold_gen(ctx->model.folds);
+    frame->screen_top = fold_screen_row(ctx->model.folds, view->rowoff);
+    frame->cursors_gen = view->cursors_gen;
+    frame->cursor_first = 1;
+    frame->cursor_last = 0;
+    if (view->cursor_count > 0) {
+        frame->cursor_first = view->cursors[0].row;
+        frame->cursor_last = view->cursors[view->cursor_count - 1].row;
+    }
+}
+
+/* Did the selection change between the frames in a way that shows on
+ * 'filerow'? */
+static int selection_damages_row(const ViewFrame *prev, const ViewFrame *now,
+                                 int filerow) {
+    /* The extra cursors are drawn like a selection of one column */
+    if (prev->cursors_gen != now->cursors_gen &&
+        ((filerow >= prev->cursor_first && filerow <= prev->cursor_last) ||
+         (filerow >= now->cursor_first && filerow <= now->cursor_last)))
+        return 1;
+    if (prev->sel_active == now->sel_active &&
+        (!now->sel_active ||
+         (prev->sel_start_y == now->sel_start_y &&
+          prev->sel_start_x == now->sel_start_x &&
+          prev->sel_end_y == now->sel_end_y &&
+          prev->sel_end_x == now->sel_end_x &&
+          prev->sel_block == now->sel_block)))
+        return 0;
+    if (prev->sel_active &&
+        filerow >= prev->sel_start_y && filerow <= prev->sel_end_y) return 1;
+    if (now->sel_active &&
+        filerow >= now->sel_start_y && filerow <= now->sel_end_y) return 1;
+    return 0;
+}
+
+int view_frame_reusable_row(const EditorModel *model, const ViewFrame *prev,
+                            const ViewFrame *now, int filerow) {
+    if (!prev->valid || prev->target != now->target) return -1;
+    /* Column widths and the display offset move with rows not shown */
+    if (model->columns) return -1;
+    if (prev->coloff != now->coloff || prev->text_cols != now->text_cols ||
+        prev->gutter_width != now->gutter_width ||
+        prev->fold_gen != now->fold_gen) return -1;
+    /* Wrapped rows move the rows below by more than one */
+    if (prev->wrapped || now->wrapped) return -1;
+
+    /* Rows from shift_from down may hold other lines than last time */
+    if (prev->gen < model->shift_base || filerow >= model->shift_from)
+        return -1;
+
+    int k = fold_screen_row(model->folds, filerow) - prev->screen_top;
+    if (k < 0 || k >= prev->rows || filerow >= model->numrows) return -1;
+
+    const t_erow *row = &model->row[filerow];
+    if (row->damage_gen == 0 || row->damage_gen > prev->gen) return -1;
+    if (selection_damages_row(prev, now, filerow)) return -1;
+    return k;
+}
+
+void view_frame_commit(EditorModel *model, ViewFrame *prev, ViewFrame *now) {
+    now->gen = model->damage_gen;
+    now->valid = 1;
+    *prev = *now;
+    model->shift_base = model->damage_gen;
+    model->shift_from = INT_MAX;
+}
+
+int editor_gutter_width(editor_ctx_t *ctx) {
+    EditorView *view = &ctx->view;
+    int n = ctx->model.numrows;
+    if (!view->line_numbers || n <= 0) return 0;
+    int base = lazy_base(&ctx->model);
+    if (base > 0) n += base;
+
+    if (n < view->gutter_lo || n >= view->gutter_hi) {
+        int digits = 1, lo = 1;
+        while (n / lo >= 10) {
+            lo *= 10;
+            digits++;
+        }
+        view->gutter_digits = digits;
+        view->gutter_lo = lo;
+        view->gutter_hi = lo <= INT_MAX / 10 ? lo * 10 : INT_MAX;
+    }
+    return view->gutter_digits + 1; /* Space separator */
+}
+
+void editor_status_lines(editor_ctx_t *ctx, int *current, int *total) {
+    int base = lazy_base(&ctx->model);
+    int lines = lazy_lines(&ctx->model);
+    *current = base < 0 ? 0 : base + ctx->view.rowoff + ctx->view.cy + 1;
+    *total = lines < 0 ? 0 : lines;
+}
+
+const char *editor_lang_label(editor_ctx_t *ctx) {
+    EditorView *view = &ctx->view;
+    const LokiLangOps *lang = loki_lang_for_buffer(ctx);
+
+    if (!view->lang_valid || view->lang_ops != lang) {
+        view->lang_ops = lang;
+        view->lang_valid = 1;
+        view->lang_label[0] = '\0';
+        if (lang) {
+            snprintf(view->lang_label, sizeof(view->lang_label), "%s ", lang->name);
+            for (int i = 0; view->lang_label[i]; i++) {
+                if (view->lang_label[i] >= 'a' && view->lang_label[i] <= 'z')
+                    view->lang_label[i] -= 32;
+            }
+        }
+    }
+
+    /* Initialization can change any time; the check itself is cheap */
+    if (lang && lang->is_initialized && lang->is_initialized(ctx))
+        return view->lang_label;
+    return "";
+}
+
+/* Fold 'len' bytes into a running FNV-1a hash. */
+static uint64_t stamp_mix(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+uint64_t editor_screen_stamp(const editor_ctx_t *ctx) {
+    const EditorView *view = &ctx->view;
+    const t_lua_repl *repl = ctx_repl(ctx);
+    int msg_visible = view->statusmsg[0] &&
+                      time(NULL) - view->statusmsg_time < 5;
+    uintptr_t ids[3] = {
+        (uintptr_t)ctx,
+        (uintptr_t)ctx->model.filename,
+        repl && repl->log_len > 0 ? (uintptr_t)repl->log[repl->log_len - 1] : 0
+    };
+    long state[] = {
+        (long)ctx->model.damage_gen, ctx->model.numrows, ctx->model.dirty,
+        view->cx, view->cy, view->rowoff, view->coloff,
+        view->screenrows, view->screencols, view->mode,
+        view->sel_active, view->sel_start_x, view->sel_start_y,
+        view->sel_end_x, view->sel_end_y, view->sel_block,
+        (long)view->cursors_gen, (long)fold_gen(ctx->model.folds),
+        view->line_numbers,
+        view->word_wrap, view->cmd_length, view->cmd_cursor_pos,
+        view->pending_prefix, msg_visible,
+        repl ? repl->active : 0, repl ? repl->input_len : 0,
+        repl ? repl->log_len : 0
+    };
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    h = stamp_mix(h, ids, sizeof(ids));
+    h = stamp_mix(h, state, sizeof(state));
+    if (msg_visible) h = stamp_mix(h, view->statusmsg, strlen(view->statusmsg));
+    /* 0 is what a fresh FramePacer holds: never report it */
+    return h ? h : 1;
+}
 
-/* Build render segments from a row for the renderer interface.
- * Returns number of segments created, or 0 for empty row.
- * Caller provides segments array (must be at least MAX_RENDER_SEGMENTS). */
-static int build_render_segments(editor_ctx_t *ctx, t_erow *row, int row_idx,
-                                 int coloff, int max_cols,
-                                 RenderSegment *segments) {
-    if (!row || row->rsize <= coloff) return 0;
+/* What a closed fold shows after its head: the rows it hides */
+static int fold_label(char *buf, size_t size, int hidden) {
+    int n = snprintf(buf, size, "  +%d line%s", hidden, hidden == 1 ? "" : "s");
+    return n < (int)size ? n : (int)size - 1;
+}
 
-    int len = row->rsize - coloff;
-    if (len > max_cols) len = max_cols;
-    if (len <= 0) return 0;
+/* Next segment of *segments, grown as needed */
+static RenderSegment *push_segment(RenderSegment **segments, int *cap,
+                                   int *count) {
+    if (*count == *cap) {
+        int newcap = *cap ? *cap * 2 : 64;
+        RenderSegment *p = realloc(*segments, newcap * sizeof(RenderSegment));
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *segments = p;
+        *cap = newcap;
+    }
+    return &(*segments)[(*count)++];
+}
 
-    char *c = row->render + coloff;
-    unsigned char *hl = row->hl + coloff;
+/* Segments of the 'len' bytes at 'c' highlighted by 'spans', cut where
+ * the selection, bytes sel_start..sel_end of them, starts and ends */
+static int spans_segments(const char *c, int len, const HlSpans *spans,
+                          int sel_start, int sel_end,
+                          RenderSegment **segments, int *cap) {
     int seg_count = 0;
+    for (int i = 0; i < spans->count; i++) {
+        int j = spans->span[i].start;
+        int span_end = j + spans->span[i].len;
+        while (j < span_end) {
+            /* A segment ends where the highlight or the selection changes */
+            int selected = (j >= sel_start && j < sel_end);
+            int limit = selected ? sel_end : (j < sel_start ? sel_start : len);
+            int end = limit < span_end ? limit : span_end;
+
+            RenderSegment *seg = push_segment(segments, cap, &seg_count);
+            seg->text = c + j;
+            seg->len = end - j;
+            seg->hl_type = hl_const_to_type(spans->span[i].hl);
+            seg->selected = selected;
+            j = end;
+        }
+    }
+    return seg_count;
+}
+
+/* Segments of render columns [off, off+len) of the window of a row */
+static int row_text_segments(editor_ctx_t *ctx, t_erow *row, int row_idx,
+                             int coloff, int off, int len,
+                             RenderSegment **segments, int *cap) {
+    /* Selected columns of this row, relative to coloff */
+    int sel_start = len, sel_end = len;
+    int s, e;
+    if (selection_row_span(ctx, row_idx, &s, &e)) {
+        sel_start = s - coloff < 0 ? 0 : (s - coloff > len ? len : s - coloff);
+        sel_end = e - coloff > len ? len : e - coloff;  /* e may be INT_MAX */
+        if (sel_end < sel_start) sel_end = sel_start;
+    }
+
+    HlSpans spans;
+    hl_spans_init(&spans);
+    editor_row_draw_spans(&ctx->model, row, row_idx, off, len, &spans);
+    int seg_count = spans_segments(row->render + off, len, &spans, sel_start,
+                                   sel_end, segments, cap);
+    hl_spans_free(&spans);
+    return seg_count;
+}
+
+/* Column mode: index the rows a frame shows before drawing any, so that
+ * all are drawn to the same widths */
+static void column_index_shown(editor_ctx_t *ctx, const ScreenLine *lines,
+                               int shown) {
+    if (ctx->model.columns && shown > 0)
+        columns_index_rows(ctx->model.columns, ctx->model.row, lines[0].row,
+                           lines[shown - 1].row);
+}
+
+/* Colors of the columns, in turn */
+static const unsigned char column_hl[] = {
+    HL_NORMAL, HL_KEYWORD1, HL_STRING, HL_NUMBER, HL_KEYWORD2
+};
+
+/* Column mode: row 'filerow' as drawn, its fields padded out to their
+ * columns and in their columns' colors, from display column 'col' for at
+ * most 'cols' cells. The text goes to *text (valid until the next call),
+ * its highlight to 'spans' and the selection on it to *sel_start and
+ * *sel_end, all in bytes of the text. Search matches and the like stay
+ * over the colors (of rows without TABs, whose render is their text).
+ * Returns the bytes to draw. */
+static int column_row_draw(editor_ctx_t *ctx, t_erow *row, int filerow,
+                           int col, int cols, const char **text,
+                           HlSpans *spans, int *sel_start, int *sel_end) {
+    static struct abuf line = ABUF_INIT;   /* Reused across rows */
+    const ColumnField *fields;
+    int n = columns_layout(ctx->model.columns, filerow, row->chars, row->size,
+                           &fields);
+    char delim = columns_delim(ctx->model.columns);
+
+    HlSpans hl, all;
+    hl_spans_init(&hl);
+    hl_spans_init(&all);
+    if (row->render == row->chars)
+        editor_row_draw_spans(&ctx->model, row, filerow, 0, row->size, &hl);
+    line.len = 0;
+    for (int i = 0, k = 0; i < n; i++) {
+        const ColumnField *f = &fields[i];
+        int at = line.len;
+        terminal_buffer_append(&line, row->chars + f->start, f->len);
+        hl_spans_push(&all, at, f->len, column_hl[i % (int)sizeof(column_hl)]);
+        for (; k < hl.count && hl.span[k].start < f->start + f->len; k++) {
+            const HlSpan *h = &hl.span[k];
+            int from = h->start > f->start ? h->start : f->start;
+            int to = h->start + h->len < f->start + f->len ?
+                     h->start + h->len : f->start + f->len;
+            if (h->hl != HL_NORMAL && to > from)
+                hl_spans_overlay(&all, at + from - f->start, to - from, h->hl);
+            if (h->start + h->len > f->start + f->len) break;
+        }
+        if (i + 1 == n) break;
+        int pad = fields[i + 1].col - 1 - f->col - f->width;
+        for (int j = 0; j < pad; j++) terminal_buffer_append(&line, " ", 1);
+        if (pad > 0) hl_spans_push(&all, line.len - pad, pad, HL_NORMAL);
+        terminal_buffer_append(&line, delim == '\t' ? " " : &delim, 1);
+        hl_spans_push(&all, line.len - 1, 1, HL_COMMENT);
+    }
+    hl_spans_free(&hl);
+
+    /* The part on screen */
+    int skip = utf8_fit(line.b, line.len, col);
+    int len = utf8_fit(line.b + skip, line.len - skip, cols);
+    for (int i = 0; i < all.count; i++) {
+        int from = all.span[i].start - skip, to = from + all.span[i].len;
+        if (from < 0) from = 0;
+        if (to > len) to = len;
+        if (to > from) hl_spans_push(spans, from, to - from, all.span[i].hl);
+    }
+    hl_spans_free(&all);
+
+    *sel_start = *sel_end = len;
+    int s, e;
+    if (selection_row_span(ctx, filerow, &s, &e)) {
+        s = columns_display_col(fields, n, row->chars, s < row->size ? s : row->size);
+        *sel_start = utf8_fit(line.b, line.len, s) - skip;
+        if (e != INT_MAX) {
+            e = columns_display_col(fields, n, row->chars, e < row->size ? e : row->size);
+            *sel_end = utf8_fit(line.b, line.len, e) - skip;
+        }
+        if (*sel_start < 0) *sel_start = 0;
+        if (*sel_start > len) *sel_start = len;
+        if (*sel_end > len) *sel_end = len;
+        if (*sel_end < *sel_start) *sel_end = *sel_start;
+    }
+    *text = line.b + skip;
+    return len;
+}
+
+int editor_row_segments(editor_ctx_t *ctx, t_erow *row, int row_idx,
+                        int coloff, int max_cols,
+                        RenderSegment **segments, int *cap) {
+    if (!row) return 0;
+    int seg_count = 0, used = 0, at_end = 1;
+    if (row_in_columns(&ctx->model, row)) {
+        const char *text;
+        int sel_start, sel_end;
+        HlSpans spans;
+        hl_spans_init(&spans);
+        int len = column_row_draw(ctx, row, row_idx, column_view_off(ctx),
+                                  max_cols, &text, &spans, &sel_start, &sel_end);
+        seg_count = spans_segments(text, len, &spans, sel_start, sel_end,
+                                   segments, cap);
+        hl_spans_free(&spans);
+        used = utf8_width(text, len);
+    } else {
+        int off = coloff - row->render_off;  /* Into the render window */
+        int len = off < 0 ? 0 : row->rsize - off;
+        if (len > 0) len = utf8_fit(row->render + off, len, max_cols);
+        if (len > 0) {
+            seg_count = row_text_segments(ctx, row, row_idx, coloff, off, len,
+                                          segments, cap);
+            used = utf8_width(row->render + off, len);
+        }
+        at_end = off + (len > 0 ? len : 0) >= row->rsize;
+    }
 
-    int seg_start = 0;
-    int current_hl = hl[0];
-    int current_selected = is_selected(ctx, row_idx, coloff);
-
-    for (int j = 1; j <= len && seg_count < MAX_RENDER_SEGMENTS - 1; j++) {
-        int next_hl = (j < len) ? hl[j] : -1;
-        int next_selected = (j < len) ? is_selected(ctx, row_idx, coloff + j) : 0;
-
-        /* End segment if highlight or selection changes */
-        if (j == len || next_hl != current_hl || next_selected != current_selected) {
-            segments[seg_count].text = c + seg_start;
-            segments[seg_count].len = j - seg_start;
-            segments[seg_count].hl_type = hl_const_to_type(current_hl);
-            segments[seg_count].selected = current_selected;
-            seg_count++;
-            seg_start = j;
-            current_hl = next_hl;
-            current_selected = next_selected;
+    /* A suggestion on the row follows its text, dimmed: on the last
+     * screen line of a wrapped row */
+    const char *ghost;
+    int ghost_len, ghost_more;
+    if (at_end && used < max_cols &&
+        ghost_row(&ctx->model, row_idx, &ghost, &ghost_len, &ghost_more)) {
+        static char label[32];
+        int n = utf8_fit(ghost, ghost_len, max_cols - used);
+        RenderSegment *seg = push_segment(segments, cap, &seg_count);
+        seg->text = ghost;
+        seg->len = n;
+        seg->hl_type = HL_TYPE_COMMENT;
+        seg->selected = 0;
+        used += utf8_width(ghost, n);
+        if (ghost_more > 0 && used < max_cols) {
+            n = ghost_label(label, sizeof(label), ghost_more);
+            seg = push_segment(segments, cap, &seg_count);
+            seg->text = label;
+            seg->len = n < max_cols - used ? n : max_cols - used;
+            seg->hl_type = HL_TYPE_COMMENT;
+            seg->selected = 0;
+            used += seg->len;
         }
     }
 
+    /* The head of a closed fold says how much it hides */
+    int fold_last = fold_closed_last(ctx->model.folds, row_idx);
+    if (fold_last >= 0 && used < max_cols) {
+        static char label[32];  /* Read before the next row is built */
+        int n = fold_label(label, sizeof(label), fold_last - row_idx);
+        int room = max_cols - used;
+        RenderSegment *seg = push_segment(segments, cap, &seg_count);
+        seg->text = label;
+        seg->len = n < room ? n : room;
+        seg->hl_type = HL_TYPE_COMMENT;
+        seg->selected = 0;
+    }
     return seg_count;
 }
 
+/* Context whose frame a renderer shows; buffers share one renderer, so a
+ * context can only repeat rows of the frame it drew itself. */
+static const Renderer *frame_renderer = NULL;
+static const editor_ctx_t *frame_owner = NULL;
+
 /* Refresh screen using renderer interface.
- * This is the abstract rendering path that doesn't emit VT100 directly. */
+ * This is the abstract rendering path that doesn't emit VT100 directly.
+ * Rows that did not change since the previous frame are repeated by the
+ * renderer instead of being segmented again. */
 static void editor_refresh_screen_via_renderer(editor_ctx_t *ctx) {
     Renderer *r = ctx->renderer;
     int tabs_showing = (buffer_count() > 1) ? 1 : 0;
     int available_rows = ctx->view.screenrows - tabs_showing;
 
-    /* Calculate gutter width for line numbers */
-    int gutter_width = 0;
-    if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-        int max_line = ctx->model.numrows;
-        gutter_width = 1;
-        while (max_line >= 10) {
-            gutter_width++;
-            max_line /= 10;
-        }
-        gutter_width += 1; /* Space separator */
-    }
+    lazy_follow_cursor(ctx);
+    int gutter_width = editor_gutter_width(ctx);
+    int line_base = lazy_base(&ctx->model);
 
     int text_cols = ctx->view.screencols - gutter_width;
     if (text_cols < 1) text_cols = 1;
@@ -640,19 +2794,40 @@ static void editor_refresh_screen_via_renderer(editor_ctx_t *ctx) {
         }
     }
 
-    /* Render each row */
-    RenderSegment segments[MAX_RENDER_SEGMENTS];
+    /* Render each row: the shown ones, past closed folds, wrapped */
+    editor_view_fix(ctx);
+    int shown, wrapped;
+    const ScreenLine *lines = editor_screen_lines(ctx, available_rows, &shown,
+                                                  &wrapped);
+    uint64_t span = trace_begin();
+    column_index_shown(ctx, lines, shown);
+    ViewFrame frame;
+    view_frame_capture(ctx, &frame, r, available_rows, text_cols, gutter_width);
+    frame.wrapped = wrapped;
+    if (frame_renderer != r || frame_owner != ctx) ctx->frame.valid = 0;
+
+    static RenderSegment *segments = NULL;  /* Reused across frames */
+    static int seg_cap = 0;
     for (int y = 0; y < available_rows; y++) {
-        int filerow = ctx->view.rowoff + y;
-        int is_empty = (filerow >= ctx->model.numrows);
-
-        if (is_empty) {
+        if (y >= shown) {
             r->render_row(r, 0, NULL, 0, gutter_width, 1);
         } else {
-            t_erow *row = &ctx->model.row[filerow];
-            int seg_count = build_render_segments(ctx, row, filerow,
-                                                  ctx->view.coloff, text_cols, segments);
-            r->render_row(r, filerow + 1, segments, seg_count, gutter_width, 0);
+            const ScreenLine *line = &lines[y];
+            int filerow = line->row;
+            int col = line->start >= 0 ? line->start : ctx->view.coloff;
+            t_erow *row = editor_visible_row(ctx, filerow, col, line->len);
+            int k = view_frame_reusable_row(&ctx->model, &ctx->frame, &frame,
+                                            filerow);
+            if (k >= 0 && r->reuse_row && r->reuse_row(r, k)) continue;
+
+            int seg_count = editor_row_segments(ctx, row, filerow, col,
+                                                line->len, &segments, &seg_cap);
+            /* Rows a wrapped row goes on to have no line number, nor
+             * those of a large file not indexed that far yet */
+            int row_num = line->start > 0 || line_base < 0 ?
+                          0 : line_base + filerow + 1;
+            r->render_row(r, row_num, segments, seg_count, gutter_width, 0);
+            frame.rows_rebuilt++;
         }
     }
 
@@ -662,40 +2837,33 @@ static void editor_refresh_screen_via_renderer(editor_ctx_t *ctx) {
     switch(ctx->view.mode) {
         case MODE_NORMAL: mode_str = link_active ? "LINK" : "NORMAL"; break;
         case MODE_INSERT: mode_str = "INSERT"; break;
-        case MODE_VISUAL: mode_str = "VISUAL"; break;
+        case MODE_VISUAL:
+            mode_str = ctx->view.sel_block ? "VISUAL BLOCK" : "VISUAL";
+            break;
         case MODE_COMMAND: mode_str = "COMMAND"; break;
     }
 
-    const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
-    static char lang_buf[16] = "";
-    if (lang && lang->is_initialized && lang->is_initialized(ctx)) {
-        snprintf(lang_buf, sizeof(lang_buf), "%s ", lang->name);
-        for (int i = 0; lang_buf[i] && i < 15; i++) {
-            if (lang_buf[i] >= 'a' && lang_buf[i] <= 'z') {
-                lang_buf[i] -= 32;
-            }
-        }
-    } else {
-        lang_buf[0] = '\0';
-    }
-
+    int status_current, status_total;
+    editor_status_lines(ctx, &status_current, &status_total);
     StatusInfo status_info = {
         .mode = mode_str,
         .filename = ctx->model.filename,
-        .lang = lang_buf,
-        .numrows = ctx->model.numrows,
-        .current_row = ctx->view.rowoff + ctx->view.cy + 1,
+        .lang = editor_lang_label(ctx),
+        .numrows = status_total,
+        .current_row = status_current,
         .dirty = ctx->model.dirty,
         .playing = loki_lang_is_playing(ctx),
         .link_active = link_active,
     };
     r->render_status(r, &status_info, ctx->view.screencols);
 
-    /* Render message line */
+    /* Render message line, under the performance HUD if it is on */
     const char *msg = NULL;
     if (ctx->view.statusmsg[0] && time(NULL) - ctx->view.statusmsg_time < 5) {
         msg = ctx->view.statusmsg;
     }
+    char hud_line[256];
+    msg = perfhud_message_line(msg, ctx->view.screencols, hud_line, sizeof(hud_line));
     r->render_message(r, msg, ctx->view.screencols);
 
     /* Render REPL if active */
@@ -725,32 +2893,61 @@ static void editor_refresh_screen_via_renderer(editor_ctx_t *ctx) {
         if (cursor_col < 1) cursor_col = 1;
         if (cursor_col > ctx->view.screencols) cursor_col = ctx->view.screencols;
     } else {
-        int cx = 1;
-        int filerow = ctx->view.rowoff + ctx->view.cy;
-        t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
-        if (row) {
-            for (int j = ctx->view.coloff; j < (ctx->view.cx + ctx->view.coloff); j++) {
-                if (j < row->size && row->chars[j] == TAB)
-                    cx += 7 - ((cx) % 8);
-                cx++;
-            }
-        }
-        if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-            int gw = 1, max_ln = ctx->model.numrows;
-            while (max_ln >= 10) { gw++; max_ln /= 10; }
-            gw += 1;
-            cx += gw;
-        }
+        int cx = editor_cursor_screen_col(ctx) + 1 + gutter_width;
         int tab_offset = tabs_showing ? 1 : 0;
-        cursor_row = ctx->view.cy + 1 + tab_offset;
+        cursor_row = editor_cursor_screen_row(ctx) + 1 + tab_offset;
         cursor_col = cx;
         if (cursor_col > ctx->view.screencols) cursor_col = ctx->view.screencols;
     }
 
     r->set_cursor(r, cursor_row, cursor_col);
+    trace_end("rows", span);
 
     /* End frame */
+    span = trace_begin();
     r->end_frame(r);
+    trace_end("flush", span);
+    trace_frame_shown();
+    if (perfhud_enabled()) {
+        TerminalRenderStats out;
+        terminal_renderer_get_stats(r, &out);
+        perfhud_frame(out.frame_bytes, frame.rows_rebuilt);
+    }
+    view_frame_commit(&ctx->model, &ctx->frame, &frame);
+    frame_renderer = r;
+    frame_owner = ctx;
+}
+
+/* Foreground of the VT100 path: a HL_* color, or one of these */
+#define VT_FG_DEFAULT -1
+#define VT_FG_GUTTER -2
+
+/* SGR attributes last sent by the VT100 path */
+typedef struct {
+    int fg;
+    int reverse;
+} VtPen;
+
+/* Switch the terminal to the given attributes, sending only what changed. */
+static void vt_set_pen(struct abuf *ab, editor_ctx_t *ctx, VtPen *pen,
+                       int fg, int reverse) {
+    if (pen->reverse != reverse) {
+        if (reverse) terminal_buffer_append(ab,"\x1b[7m",4);
+        else terminal_buffer_append(ab,"\x1b[27m",5);
+        pen->reverse = reverse;
+    }
+    if (pen->fg != fg) {
+        if (fg == VT_FG_DEFAULT) {
+            terminal_buffer_append(ab,"\x1b[39m",5);
+        } else if (fg == VT_FG_GUTTER) {
+            terminal_buffer_append(ab,"\x1b[90m",5); /* Dark gray */
+        } else {
+            int len;
+            const char *sgr = syntax_color_sgr(ctx, fg, &len);
+            terminal_buffer_append(ab,sgr,len);
+        }
+        pen->fg = fg;
+    }
 }
 
 /* This function writes the whole screen using VT100 escape characters
@@ -764,8 +2961,10 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
     int y;
     t_erow *r;
     char buf[32];
-    struct abuf ab = ABUF_INIT;
+    static struct abuf ab = ABUF_INIT;  /* Reused across frames */
 
+    ab.len = 0;
+    terminal_sync_begin(&ab);
     terminal_buffer_append(&ab,"\x1b[?25l",6); /* Hide cursor. */
     terminal_buffer_append(&ab,"\x1b[H",3); /* Go home. */
 
@@ -776,32 +2975,34 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
     /* Reduce available rows if tabs are showing */
     int available_rows = ctx->view.screenrows - tabs_showing;
 
-    /* Calculate gutter width for line numbers */
-    int gutter_width = 0;
-    if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-        /* Width = digits needed for max line number + 1 for separator */
-        int max_line = ctx->model.numrows;
-        gutter_width = 1; /* At least 1 digit */
-        while (max_line >= 10) {
-            gutter_width++;
-            max_line /= 10;
-        }
-        gutter_width += 1; /* Space separator after number */
-    }
+    /* Line number gutter: digits of the line count plus a separator */
+    lazy_follow_cursor(ctx);
+    int gutter_width = editor_gutter_width(ctx);
+    int line_base = lazy_base(&ctx->model);
 
     /* Available cols for text after gutter */
     int text_cols = ctx->view.screencols - gutter_width;
     if (text_cols < 1) text_cols = 1;
 
+    /* Attributes are tracked across rows, starting from a reset */
+    VtPen pen = {VT_FG_DEFAULT, 0};
+    terminal_buffer_append(&ab,"\x1b[0m",4);
+
+    editor_view_fix(ctx);
+    int shown, wrapped;
+    const ScreenLine *lines = editor_screen_lines(ctx, available_rows, &shown,
+                                                  &wrapped);
+    uint64_t span = trace_begin();
+    column_index_shown(ctx, lines, shown);
+    int column_off = ctx->model.columns ? column_view_off(ctx) : 0;
     for (y = 0; y < available_rows; y++) {
-        int filerow = ctx->view.rowoff+y;
-
-        if (filerow >= ctx->model.numrows) {
+        if (y >= shown) {
             if (ctx->model.numrows == 0 && y == available_rows/3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome,sizeof(welcome),
                     "Loki editor -- version %s\x1b[0K\r\n", LOKI_VERSION);
                 int padding = (ctx->view.screencols-welcomelen)/2;
+                vt_set_pen(&ab, ctx, &pen, VT_FG_DEFAULT, 0);
                 if (padding) {
                     terminal_buffer_append(&ab,"~",1);
                     padding--;
@@ -811,111 +3012,117 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
             } else {
                 /* Empty lines: show gutter filler if line numbers enabled */
                 if (ctx->view.line_numbers && gutter_width > 0) {
-                    terminal_buffer_append(&ab,"\x1b[90m",5); /* Dark gray */
+                    vt_set_pen(&ab, ctx, &pen, VT_FG_GUTTER, 0);
                     for (int i = 0; i < gutter_width - 1; i++)
                         terminal_buffer_append(&ab," ",1);
-                    terminal_buffer_append(&ab,"~",1);
-                    terminal_buffer_append(&ab,"\x1b[39m",5); /* Reset */
                 } else {
-                    terminal_buffer_append(&ab,"~",1);
+                    vt_set_pen(&ab, ctx, &pen, VT_FG_DEFAULT, 0);
                 }
+                terminal_buffer_append(&ab,"~",1);
                 terminal_buffer_append(&ab,"\x1b[0K\r\n",6);
             }
             continue;
         }
+        const ScreenLine *line = &lines[y];
+        int filerow = line->row;
+        int col = line->start >= 0 ? line->start : ctx->view.coloff;
+        int cols = line->len;
 
-        /* Render line number gutter */
+        /* Render line number gutter; blank where a wrapped row goes on */
         if (ctx->view.line_numbers && gutter_width > 0) {
             char line_num_buf[16];
-            int line_num_len = snprintf(line_num_buf, sizeof(line_num_buf),
-                "%*d ", gutter_width - 1, filerow + 1);
-            terminal_buffer_append(&ab,"\x1b[90m",5); /* Dark gray for line numbers */
+            int line_num_len = line->start > 0 || line_base < 0 ?
+                snprintf(line_num_buf, sizeof(line_num_buf), "%*s",
+                         gutter_width, "") :
+                snprintf(line_num_buf, sizeof(line_num_buf),
+                         "%*d ", gutter_width - 1, line_base + filerow + 1);
+            vt_set_pen(&ab, ctx, &pen, VT_FG_GUTTER, 0);
             terminal_buffer_append(&ab, line_num_buf, line_num_len);
-            terminal_buffer_append(&ab,"\x1b[39m",5); /* Reset foreground */
         }
 
-        r = &ctx->model.row[filerow];
-
-        int len = r->rsize - ctx->view.coloff;
-        int current_color = -1;
-
-        /* Word wrap: clamp to screen width and find word boundary */
-        if (ctx->view.word_wrap && len > text_cols && r->cb_lang == CB_LANG_NONE) {
-            len = text_cols;
-            /* Find last space/separator to break at word boundary */
-            int last_space = -1;
-            for (int k = 0; k < len; k++) {
-                if (isspace(r->render[ctx->view.coloff + k])) {
-                    last_space = k;
-                }
-            }
-            if (last_space > 0 && last_space > len / 2) {
-                len = last_space + 1; /* Include the space */
+        r = editor_visible_row(ctx, filerow, col, cols);
+
+        int off = col - r->render_off;  /* Into the window */
+        int len = r->rsize - off;
+        const char *c = r->render + off;
+        int sel_start = 0, sel_end = 0;
+        HlSpans spans;
+        hl_spans_init(&spans);
+        if (row_in_columns(&ctx->model, r)) {
+            len = column_row_draw(ctx, r, filerow, column_off, cols, &c, &spans,
+                                  &sel_start, &sel_end);
+        } else if (len > 0) {
+            len = utf8_fit(r->render + off, len, cols);
+            if (selection_row_span(ctx, filerow, &sel_start, &sel_end)) {
+                sel_start -= col;
+                if (sel_end != INT_MAX) sel_end -= col;
             }
+            editor_row_draw_spans(&ctx->model, r, filerow, off, len, &spans);
         }
 
         if (len > 0) {
-            if (len > text_cols) len = text_cols;
-            char *c = r->render+ctx->view.coloff;
-            unsigned char *hl = r->hl+ctx->view.coloff;
-            int j;
-            for (j = 0; j < len; j++) {
-                int selected = is_selected(ctx, filerow, ctx->view.coloff + j);
-
-                /* Apply selection background */
-                if (selected) {
-                    terminal_buffer_append(&ab,"\x1b[7m",4); /* Reverse video */
-                }
-
-                if (hl[j] == HL_NONPRINT) {
-                    char sym;
-                    if (!selected) terminal_buffer_append(&ab,"\x1b[7m",4);
-                    if (c[j] <= 26)
-                        sym = '@'+c[j];
-                    else
-                        sym = '?';
-                    terminal_buffer_append(&ab,&sym,1);
-                    terminal_buffer_append(&ab,"\x1b[0m",4);
-                    if (current_color != -1) {
-                        char buf[32];
-                        int clen = syntax_format_color(ctx, current_color, buf, sizeof(buf));
-                        terminal_buffer_append(&ab,buf,clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        terminal_buffer_append(&ab,"\x1b[39m",5);
-                        current_color = -1;
-                    }
-                    terminal_buffer_append(&ab,c+j,1);
-                    if (selected) {
-                        terminal_buffer_append(&ab,"\x1b[0m",4); /* Reset */
-                    }
-                } else {
-                    int color = hl[j];
-                    if (color != current_color) {
-                        char buf[32];
-                        int clen = syntax_format_color(ctx, color, buf, sizeof(buf));
-                        current_color = color;
-                        terminal_buffer_append(&ab,buf,clen);
-                    }
-                    terminal_buffer_append(&ab,c+j,1);
-                    if (selected) {
-                        terminal_buffer_append(&ab,"\x1b[0m",4); /* Reset */
-                        if (current_color != -1) {
-                            char buf[32];
-                            int clen = syntax_format_color(ctx, current_color, buf, sizeof(buf));
-                            terminal_buffer_append(&ab,buf,clen);
-                        }
+            for (int i = 0; i < spans.count; i++) {
+                int hl = spans.span[i].hl;
+                int j = spans.span[i].start;
+                int end = j + spans.span[i].len;
+
+                if (hl == HL_NONPRINT) {
+                    /* Shown reversed in the current color */
+                    for (; j < end; j++) {
+                        char sym = (c[j] <= 26) ? '@'+c[j] : '?';
+                        vt_set_pen(&ab, ctx, &pen, pen.fg == VT_FG_GUTTER ?
+                                   VT_FG_DEFAULT : pen.fg, 1);
+                        terminal_buffer_append(&ab,&sym,1);
                     }
+                    continue;
+                }
+                int fg = (hl == HL_NORMAL) ? VT_FG_DEFAULT : hl;
+                while (j < end) {
+                    /* The run is cut where the selection starts or ends */
+                    int selected = j >= sel_start && j < sel_end;
+                    int cut = selected ? sel_end : (j < sel_start ? sel_start : end);
+                    if (cut > end) cut = end;
+                    vt_set_pen(&ab, ctx, &pen, fg, selected);
+                    terminal_buffer_append(&ab,c+j,cut-j);
+                    j = cut;
                 }
             }
         }
-        terminal_buffer_append(&ab,"\x1b[39m",5);
+        hl_spans_free(&spans);
+        int used = len > 0 ? utf8_width(c, len) : 0;
+        const char *ghost;
+        int ghost_len, ghost_more;
+        int at_end = row_in_columns(&ctx->model, r) || off + (len > 0 ? len : 0) >= r->rsize;
+        if (at_end && used < cols &&
+            ghost_row(&ctx->model, filerow, &ghost, &ghost_len, &ghost_more)) {
+            int n = utf8_fit(ghost, ghost_len, cols - used);
+            vt_set_pen(&ab, ctx, &pen, HL_COMMENT, 0);
+            terminal_buffer_append(&ab, ghost, n);
+            used += utf8_width(ghost, n);
+            if (ghost_more > 0 && used < cols) {
+                char label[32];
+                n = ghost_label(label, sizeof(label), ghost_more);
+                if (n > cols - used) n = cols - used;
+                terminal_buffer_append(&ab, label, n);
+                used += n;
+            }
+        }
+        int fold_last = fold_closed_last(ctx->model.folds, filerow);
+        if (fold_last >= 0 && used < cols) {
+            char label[32];
+            int n = fold_label(label, sizeof(label), fold_last - filerow);
+            vt_set_pen(&ab, ctx, &pen, HL_COMMENT, 0);
+            terminal_buffer_append(&ab, label,
+                                   n < cols - used ? n : cols - used);
+        }
+        /* Erase with the normal background */
+        vt_set_pen(&ab, ctx, &pen, pen.fg, 0);
         terminal_buffer_append(&ab,"\x1b[0K",4);
         terminal_buffer_append(&ab,"\r\n",2);
     }
 
     /* Create a two rows status. First row: */
+    terminal_buffer_append(&ab,"\x1b[0m",4);
     terminal_buffer_append(&ab,"\x1b[0K",4);
     terminal_buffer_append(&ab,"\x1b[7m",4);
     char status[80], rstatus[80];
@@ -927,32 +3134,24 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
     switch(ctx->view.mode) {
         case MODE_NORMAL: mode_str = link_active ? "LINK" : "NORMAL"; break;
         case MODE_INSERT: mode_str = "INSERT"; break;
-        case MODE_VISUAL: mode_str = "VISUAL"; break;
+        case MODE_VISUAL:
+            mode_str = ctx->view.sel_block ? "VISUAL BLOCK" : "VISUAL";
+            break;
         case MODE_COMMAND: mode_str = "COMMAND"; break;
     }
 
     /* Show language indicator if a language is active for this file */
-    const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
-    const char *lang_str = "";
-    char lang_buf[16] = "";
-    if (lang && lang->is_initialized && lang->is_initialized(ctx)) {
-        snprintf(lang_buf, sizeof(lang_buf), "%s ", lang->name);
-        /* Uppercase the language name */
-        for (int i = 0; lang_buf[i] && i < 15; i++) {
-            if (lang_buf[i] >= 'a' && lang_buf[i] <= 'z') {
-                lang_buf[i] -= 32;
-            }
-        }
-        lang_str = lang_buf;
-    }
+    const char *lang_str = editor_lang_label(ctx);
 
+    int status_current, status_total;
+    editor_status_lines(ctx, &status_current, &status_total);
     int len = snprintf(status, sizeof(status), " %s%s  %.20s - %d lines %s",
-        lang_str, mode_str, ctx->model.filename, ctx->model.numrows, ctx->model.dirty ? "(modified)" : "");
+        lang_str, mode_str, ctx->model.filename, status_total, ctx->model.dirty ? "(modified)" : "");
 
     /* Show playing indicator if any language is playing */
     const char *playing = loki_lang_is_playing(ctx) ? "[PLAYING] " : "";
     int rlen = snprintf(rstatus, sizeof(rstatus),
-        "%s%d/%d", playing, ctx->view.rowoff+ctx->view.cy+1, ctx->model.numrows);
+        "%s%d/%d", playing, status_current, status_total);
     if (len > ctx->view.screencols) len = ctx->view.screencols;
     terminal_buffer_append(&ab,status,len);
     while(len < ctx->view.screencols) {
@@ -972,9 +3171,14 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
 
     /* Second row depends on ctx->view.statusmsg and the status message update time. */
     terminal_buffer_append(&ab,"\x1b[0K",4);
-    int msglen = strlen(ctx->view.statusmsg);
-    if (msglen && time(NULL)-ctx->view.statusmsg_time < 5)
-        terminal_buffer_append(&ab,ctx->view.statusmsg,msglen <= ctx->view.screencols ? msglen : ctx->view.screencols);
+    const char *msg = NULL;
+    if (ctx->view.statusmsg[0] && time(NULL)-ctx->view.statusmsg_time < 5)
+        msg = ctx->view.statusmsg;
+    char hud_line[256];
+    msg = perfhud_message_line(msg, ctx->view.screencols, hud_line, sizeof(hud_line));
+    int msglen = msg ? (int)strlen(msg) : 0;
+    if (msglen)
+        terminal_buffer_append(&ab,msg,msglen <= ctx->view.screencols ? msglen : ctx->view.screencols);
 
     /* Render REPL if active */
     t_lua_repl *repl = ctx_repl(ctx);
@@ -1000,27 +3204,12 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
         if (cursor_col > ctx->view.screencols) cursor_col = ctx->view.screencols;
     } else {
         /* Editor mode: cursor is in the text area */
-        int cx = 1;
-        int filerow = ctx->view.rowoff+ctx->view.cy;
-        t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
-        if (row) {
-            for (int j = ctx->view.coloff; j < (ctx->view.cx+ctx->view.coloff); j++) {
-                if (j < row->size && row->chars[j] == TAB)
-                    cx += 7-((cx)%8);
-                cx++;
-            }
-        }
+        int cx = editor_cursor_screen_col(ctx) + 1;
         /* Account for line numbers gutter */
-        if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-            int gw = 1;
-            int max_ln = ctx->model.numrows;
-            while (max_ln >= 10) { gw++; max_ln /= 10; }
-            gw += 1; /* Space separator */
-            cx += gw;
-        }
+        cx += gutter_width;
         /* Account for tab bar at top if multiple buffers are open */
         int tab_offset = (buffer_count() > 1) ? 1 : 0;
-        cursor_row = ctx->view.cy + 1 + tab_offset;
+        cursor_row = editor_cursor_screen_row(ctx) + 1 + tab_offset;
         cursor_col = cx;
         if (cursor_col > ctx->view.screencols) cursor_col = ctx->view.screencols;
     }
@@ -1028,8 +3217,14 @@ void editor_refresh_screen(editor_ctx_t *ctx) {
     snprintf(buf,sizeof(buf),"\x1b[%d;%dH",cursor_row,cursor_col);
     terminal_buffer_append(&ab,buf,strlen(buf));
     terminal_buffer_append(&ab,"\x1b[?25h",6); /* Show cursor. */
-    write(STDOUT_FILENO,ab.b,ab.len);
-    terminal_buffer_free(&ab);
+    terminal_sync_end(&ab);
+    trace_end("rows", span);
+
+    span = trace_begin();
+    terminal_write_all(STDOUT_FILENO, ab.b, (size_t)ab.len);
+    trace_end("flush", span);
+    trace_frame_shown();
+    perfhud_frame((size_t)ab.len, shown);     /* Every row is redrawn */
 }
 
 /* REPL layout management, toggle function, and status reporter are in loki_editor.c */
@@ -1044,6 +3239,19 @@ void editor_move_cursor(editor_ctx_t *ctx, int key) {
     int filecol = ctx->view.coloff+ctx->view.cx;
     int rowlen;
     t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
+    FoldSet *folds = ctx->model.folds;
+
+    if (fold_hidden(folds) > 0 && (key == ARROW_UP || key == ARROW_DOWN)) {
+        /* A closed fold is one step, like the row it shows as */
+        if (key == ARROW_UP) {
+            editor_scroll_to_row(ctx, fold_prev(folds, filerow));
+        } else if (filerow < ctx->model.numrows) {
+            int next = fold_next(folds, filerow);
+            editor_scroll_to_row(ctx, next < ctx->model.numrows ?
+                                      next : ctx->model.numrows);
+        }
+        key = 0;
+    }
 
     switch(key) {
     case ARROW_LEFT:
@@ -1098,6 +3306,13 @@ void editor_move_cursor(editor_ctx_t *ctx, int key) {
         }
         break;
     }
+    /* Stepped into a closed fold from a row next to it: on to its head
+     * going left, past it going right */
+    filerow = ctx->view.rowoff+ctx->view.cy;
+    if (fold_head(folds, filerow) != filerow) {
+        int head = fold_head(folds, filerow);
+        editor_scroll_to_row(ctx, key == ARROW_RIGHT ? fold_next(folds, head) : head);
+    }
     /* Fix cx if the current line has not enough chars. */
     filerow = ctx->view.rowoff+ctx->view.cy;
     filecol = ctx->view.coloff+ctx->view.cx;
@@ -1110,6 +3325,72 @@ void editor_move_cursor(editor_ctx_t *ctx, int key) {
             ctx->view.cx = 0;
         }
     }
+    /* A UTF-8 character is one step: on past its continuation bytes */
+    filecol = ctx->view.coloff+ctx->view.cx;
+    if ((key == ARROW_LEFT || key == ARROW_RIGHT) && filecol > 0 &&
+        filecol < rowlen && utf8_is_cont(row->chars[filecol]))
+        editor_move_cursor(ctx, key);
+    /* Near an end of a large file's window: move the window */
+    lazy_follow_cursor(ctx);
+}
+
+void editor_move_cursor_count(editor_ctx_t *ctx, int key, int count) {
+    int numrows = ctx->model.numrows;
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+
+    if (count <= 1 || fold_hidden(ctx->model.folds) > 0 || row > numrows) {
+        for (int i = 0; i < count; i++) {
+            int cx = ctx->view.cx, cy = ctx->view.cy;
+            int rowoff = ctx->view.rowoff, coloff = ctx->view.coloff;
+            editor_move_cursor(ctx, key);
+            if (cx == ctx->view.cx && cy == ctx->view.cy &&
+                rowoff == ctx->view.rowoff && coloff == ctx->view.coloff)
+                break;
+        }
+        return;
+    }
+
+    switch (key) {
+    case ARROW_UP:
+        row = row > count ? row - count : 0;
+        break;
+    case ARROW_DOWN:
+        row = numrows - row > count ? row + count : numrows;
+        break;
+    case ARROW_LEFT:
+        while (count > 0 && (col > 0 || row > 0)) {
+            if (col == 0) {
+                row--;
+                col = ctx->model.row[row].size;
+            } else {
+                const char *s = ctx->model.row[row].chars;
+                do col--; while (col > 0 && utf8_is_cont(s[col]));
+            }
+            count--;
+        }
+        break;
+    case ARROW_RIGHT:
+        while (count > 0 && row < numrows) {
+            const t_erow *er = &ctx->model.row[row];
+            if (col >= er->size) {
+                row++;
+                col = 0;
+            } else {
+                do col++; while (col < er->size && utf8_is_cont(er->chars[col]));
+            }
+            count--;
+        }
+        break;
+    default:
+        return;
+    }
+
+    int rowlen = row < numrows ? ctx->model.row[row].size : 0;
+    if (col > rowlen) col = rowlen;
+    editor_cursor_to(ctx, row, col);
+    editor_view_fix(ctx);
+    lazy_follow_cursor(ctx);
 }
 
 /* ========================= Modal Key Processing ============================ */
@@ -1127,17 +3408,49 @@ void init_editor(editor_ctx_t *ctx) {
     ctx->view.coloff = 0;
     ctx->model.numrows = 0;
     ctx->model.row = NULL;
+    ctx->model.rowcap = 0;
+    ctx->model.arena = NULL;
+    ctx->model.hl_stale_from = INT_MAX;
+    ctx->model.hl_pending = 0;
+    ctx->model.hl_idle = 0;
+    ctx->model.fences = NULL;
+    ctx->model.save_job = NULL;
+    ctx->model.search_index = NULL;
+    ctx->model.decor = NULL;
+    ctx->model.marks = NULL;
+    ctx->model.folds = NULL;
+    ctx->model.wrap = NULL;
+    ctx->model.utf8_cols = NULL;
+    ctx->model.lazy = NULL;
+    ctx->model.follow = NULL;
+    ctx->model.watch = NULL;
+    ctx->model.diff = NULL;
+    ctx->model.filter = NULL;
+    ctx->model.lsp = NULL;
+    ctx->model.damage_gen = 0;
+    ctx->model.shift_from = INT_MAX;
+    ctx->model.shift_base = 0;
+    ctx->model.edit_gen = 1;
+    ctx->model.snap_gen = 0;
+    memset(&ctx->frame, 0, sizeof(ctx->frame));
+    memset(&ctx->model.alloc_stats, 0, sizeof(ctx->model.alloc_stats));
     ctx->model.dirty = 0;
     ctx->model.filename = NULL;
+    ctx->model.lang.gen = 0;
     ctx->view.syntax = NULL;
+    editor_view_reset_derived(&ctx->view);
     ctx->view.mode = MODE_NORMAL;  /* Start in normal mode (vim-like) */
     ctx->view.word_wrap = 1;  /* Word wrap enabled by default */
+    ctx->view.hl_search = 0;
+    ctx->view.ignore_case = 0;
+    ctx->view.smart_case = 0;
     ctx->view.sel_active = 0;
     ctx->view.sel_start_x = ctx->view.sel_start_y = 0;
     ctx->view.sel_end_x = ctx->view.sel_end_y = 0;
 #ifdef LOKI_USE_LINENOISE
     ctx->model.ts_state = NULL;
 #endif
+    editor_model_use_arena(&ctx->model);
     syntax_init_default_colors(ctx);
     /* Lua REPL init and Lua initialization are in loki_editor.c */
     terminal_update_window_size(ctx);
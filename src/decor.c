@@ -0,0 +1,289 @@
+/* decor.c - Decorations: highlight overlays on the text
+ *
+ * See decor.h for an overview. A node's own fields are always current;
+ * drow/dcol are offsets still to be applied to its children, pushed down
+ * whenever the tree is entered below the node.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "decor.h"
+
+typedef struct DecorNode {
+    struct DecorNode *left, *right;
+    uint32_t prio;
+    int row, col, end;
+    int drow, dcol;         /* Pending for the children */
+    unsigned char hl;
+} DecorNode;
+
+struct DecorLayer {
+    DecorNode *root[DECOR_GROUPS];
+    int count[DECOR_GROUPS];
+    uint32_t seed;          /* xorshift state for priorities */
+};
+
+DecorLayer *decor_layer_new(void) {
+    DecorLayer *layer = calloc(1, sizeof(*layer));
+    if (layer) layer->seed = 0x9e3779b9u;
+    return layer;
+}
+
+static void free_tree(DecorNode *n) {
+    while (n) {
+        free_tree(n->left);
+        DecorNode *right = n->right;
+        free(n);
+        n = right;
+    }
+}
+
+void decor_layer_free(DecorLayer *layer) {
+    if (!layer) return;
+    for (int g = 0; g < DECOR_GROUPS; g++) free_tree(layer->root[g]);
+    free(layer);
+}
+
+/* Shift a subtree: its root now, its children when pushed to */
+static void shift(DecorNode *n, int drow, int dcol) {
+    if (!n) return;
+    n->row += drow;
+    n->col += dcol;
+    n->end += dcol;
+    n->drow += drow;
+    n->dcol += dcol;
+}
+
+static void push(DecorNode *n) {
+    if (n->drow || n->dcol) {
+        shift(n->left, n->drow, n->dcol);
+        shift(n->right, n->drow, n->dcol);
+        n->drow = n->dcol = 0;
+    }
+}
+
+static int before(const DecorNode *n, int row, int col) {
+    return n->row < row || (n->row == row && n->col < col);
+}
+
+/* Split 't' into the nodes before (row, col) and the rest */
+static void split(DecorNode *t, int row, int col, DecorNode **l, DecorNode **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    push(t);
+    if (before(t, row, col)) {
+        split(t->right, row, col, &t->right, r);
+        *l = t;
+    } else {
+        split(t->left, row, col, l, &t->left);
+        *r = t;
+    }
+}
+
+/* Join two trees, every node of 'l' ordered before those of 'r' */
+static DecorNode *merge(DecorNode *l, DecorNode *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->prio > r->prio) {
+        push(l);
+        l->right = merge(l->right, r);
+        return l;
+    }
+    push(r);
+    r->left = merge(l, r->left);
+    return r;
+}
+
+static void insert(DecorLayer *layer, int group, DecorNode *n) {
+    DecorNode *l, *r;
+    split(layer->root[group], n->row, n->col, &l, &r);
+    layer->root[group] = merge(merge(l, n), r);
+    layer->count[group]++;
+}
+
+static DecorNode *new_node(DecorLayer *layer, int row, int col, int end,
+                           unsigned char hl) {
+    DecorNode *n = malloc(sizeof(*n));
+    if (!n) return NULL;
+    uint32_t x = layer->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    layer->seed = x;
+    n->left = n->right = NULL;
+    n->prio = x;
+    n->row = row;
+    n->col = col;
+    n->end = end;
+    n->drow = n->dcol = 0;
+    n->hl = hl;
+    return n;
+}
+
+int decor_add(DecorLayer *layer, int group, int row, int col, int len,
+              unsigned char hl) {
+    if (group < 0 || group >= DECOR_GROUPS || row < 0 || col < 0 || len <= 0)
+        return -1;
+    DecorNode *n = new_node(layer, row, col, col + len, hl);
+    if (!n) return -1;
+    insert(layer, group, n);
+    return 0;
+}
+
+static void visit(DecorNode *n, int group, DecorVisitFn fn, void *opaque) {
+    Decor d = { n->row, n->col, n->end, n->hl, (unsigned char)group };
+    fn(opaque, &d);
+}
+
+/* Free a subtree, passing its nodes to 'fn' first */
+static void clear_tree(DecorNode *n, int group, DecorVisitFn fn, void *opaque) {
+    while (n) {
+        push(n);
+        clear_tree(n->left, group, fn, opaque);
+        if (fn) visit(n, group, fn, opaque);
+        DecorNode *right = n->right;
+        free(n);
+        n = right;
+    }
+}
+
+void decor_clear(DecorLayer *layer, int group, DecorVisitFn fn, void *opaque) {
+    if (!layer || group < 0 || group >= DECOR_GROUPS) return;
+    clear_tree(layer->root[group], group, fn, opaque);
+    layer->root[group] = NULL;
+    layer->count[group] = 0;
+}
+
+/* Nodes in a subtree */
+static int tree_size(const DecorNode *n) {
+    int size = 0;
+    while (n) {
+        size += 1 + tree_size(n->left);
+        n = n->right;
+    }
+    return size;
+}
+
+void decor_clear_rows(DecorLayer *layer, int group, int first, int last,
+                      DecorVisitFn fn, void *opaque) {
+    if (!layer || group < 0 || group >= DECOR_GROUPS || first > last) return;
+    DecorNode *l, *mid, *r;
+    split(layer->root[group], first, 0, &l, &mid);
+    split(mid, last + 1, 0, &mid, &r);
+    layer->count[group] -= tree_size(mid);
+    clear_tree(mid, group, fn, opaque);
+    layer->root[group] = merge(l, r);
+}
+
+int decor_count(const DecorLayer *layer, int group) {
+    if (!layer || group < 0 || group >= DECOR_GROUPS) return 0;
+    return layer->count[group];
+}
+
+/* In-order walk of the nodes on 'row' only */
+static void row_each(DecorNode *n, int row, int group, DecorVisitFn fn,
+                     void *opaque) {
+    while (n) {
+        push(n);
+        if (n->row > row) {
+            n = n->left;
+        } else if (n->row < row) {
+            n = n->right;
+        } else {
+            row_each(n->left, row, group, fn, opaque);
+            visit(n, group, fn, opaque);
+            n = n->right;
+        }
+    }
+}
+
+void decor_row_each(DecorLayer *layer, int row, DecorVisitFn fn, void *opaque) {
+    if (!layer) return;
+    for (int g = DECOR_GROUPS - 1; g >= 0; g--)
+        row_each(layer->root[g], row, g, fn, opaque);
+}
+
+/* The edit being applied, for the nodes it cuts into */
+typedef struct {
+    int srow, scol, orow, ocol, nrow, ncol;
+} DecorEdit;
+
+/* Nodes on the edit's first row, starting before it: ends inside the
+ * replaced text come back to its start, ends past it move with the text
+ * (unless a line break now comes between). Empty nodes are dropped. */
+static DecorNode *cut_ends(DecorLayer *layer, int group, DecorNode *n,
+                           const DecorEdit *e) {
+    if (!n) return NULL;
+    push(n);
+    n->left = cut_ends(layer, group, n->left, e);
+    n->right = cut_ends(layer, group, n->right, e);
+    if (n->end > e->scol) {
+        if (e->srow == e->orow && e->srow == e->nrow && n->end > e->ocol)
+            n->end += e->ncol - e->ocol;
+        else
+            n->end = e->scol;
+    }
+    if (n->end > n->col) return n;
+
+    DecorNode *rest = merge(n->left, n->right);
+    free(n);
+    layer->count[group]--;
+    return rest;
+}
+
+/* Nodes starting inside the replaced text: what is left of them starts
+ * where the new text ends. Collected on 'keep' for reinsertion. */
+static void cut_starts(DecorLayer *layer, int group, DecorNode *n,
+                       const DecorEdit *e, DecorNode **keep) {
+    while (n) {
+        push(n);
+        cut_starts(layer, group, n->left, e, keep);
+        DecorNode *right = n->right;
+        layer->count[group]--;
+        if (n->row == e->orow && n->end > e->ocol) {
+            n->end += e->ncol - e->ocol;
+            n->row = e->nrow;
+            n->col = e->ncol;
+            n->left = NULL;
+            n->right = *keep;
+            *keep = n;
+        } else {
+            free(n);
+        }
+        n = right;
+    }
+}
+
+void decor_note_edit(DecorLayer *layer, int start_row, int start_col,
+                     int old_end_row, int old_end_col,
+                     int new_end_row, int new_end_col) {
+    if (!layer) return;
+    DecorEdit e = { start_row, start_col, old_end_row, old_end_col,
+                    new_end_row, new_end_col };
+
+    for (int g = 0; g < DECOR_GROUPS; g++) {
+        if (!layer->root[g]) continue;
+        DecorNode *a, *b, *c, *d, *rest;
+        split(layer->root[g], start_row, 0, &a, &rest);
+        split(rest, start_row, start_col, &b, &rest);
+        split(rest, old_end_row, old_end_col, &c, &rest);
+        split(rest, old_end_row + 1, 0, &d, &rest);
+
+        b = cut_ends(layer, g, b, &e);
+        shift(d, new_end_row - old_end_row, new_end_col - old_end_col);
+        shift(rest, new_end_row - old_end_row, 0);
+        layer->root[g] = merge(merge(a, b), merge(d, rest));
+
+        DecorNode *keep = NULL;
+        cut_starts(layer, g, c, &e, &keep);
+        while (keep) {
+            DecorNode *next = keep->right;
+            keep->right = NULL;
+            insert(layer, g, keep);
+            keep = next;
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/* decor.h - Decorations: highlight overlays on the text
+ *
+ * Search matches and markers set from Lua (lint results, say) are drawn
+ * over the syntax highlight rather than written into row->hl_buf.hl, so adding
+ * or clearing them re-highlights nothing. A decoration covers chars
+ * [col, end) of one row and belongs to one of DECOR_GROUPS groups.
+ *
+ * Each group is a treap ordered by (row, col). Edits reported through
+ * decor_note_edit() move the decorations after them: a whole subtree is
+ * shifted at once through offsets applied lazily on the way down, so an
+ * edit costs O(log n) plus the decorations it actually cuts into. Adding
+ * one is O(log n), reading a row's O(log n + k), and clearing a group
+ * O(k). The renderer merges a row's decorations with its highlight when
+ * it builds the row's runs (see editor_row_draw_spans()).
+ */
+
+#ifndef LOKI_DECOR_H
+#define LOKI_DECOR_H
+
+#define DECOR_GROUPS        11
+#define DECOR_GROUP_SEARCH  0   /* Search matches (editor_find()) */
+#define DECOR_GROUP_LUA     1   /* First of the groups of loki.decorate() */
+#define DECOR_GROUP_LUA_END 8   /* ... and past the last */
+#define DECOR_GROUP_DIFF    8   /* Lines a :diff found changed (diffview.h) */
+#define DECOR_GROUP_LSP     9   /* Diagnostics of a language server (lsp.h) */
+#define DECOR_GROUP_SPELL   10  /* Misspelt words (spell.h) */
+
+typedef struct DecorLayer DecorLayer;
+
+/* A decoration as read back: chars [col, end) highlighted 'hl' */
+typedef struct Decor {
+    int row;
+    int col;
+    int end;
+    unsigned char hl;
+    unsigned char group;
+} Decor;
+
+typedef void (*DecorVisitFn)(void *opaque, const Decor *decor);
+
+/* Create an empty layer. Returns NULL on out of memory. */
+DecorLayer *decor_layer_new(void);
+
+/* Release a layer and its decorations. Safe on NULL. */
+void decor_layer_free(DecorLayer *layer);
+
+/* Add a decoration over chars [col, col+len) of 'row' to 'group'.
+ * Returns 0, or -1 if the group or the range is invalid. */
+int decor_add(DecorLayer *layer, int group, int row, int col, int len,
+              unsigned char hl);
+
+/* Remove every decoration of 'group', passing each to 'fn' (may be NULL)
+ * first, so the rows they were on can be redrawn. */
+void decor_clear(DecorLayer *layer, int group, DecorVisitFn fn, void *opaque);
+
+/* Remove the decorations of 'group' on rows first..last, passing each to
+ * 'fn' (may be NULL) first. */
+void decor_clear_rows(DecorLayer *layer, int group, int first, int last,
+                      DecorVisitFn fn, void *opaque);
+
+/* Decorations in 'group'. */
+int decor_count(const DecorLayer *layer, int group);
+
+/* Pass the decorations of 'row' to 'fn': the groups from the last to
+ * DECOR_GROUP_SEARCH, so that lower groups are drawn over higher ones,
+ * each in column order. */
+void decor_row_each(DecorLayer *layer, int row, DecorVisitFn fn, void *opaque);
+
+/* The text from (start_row, start_col) up to (old_end_row, old_end_col)
+ * was replaced by text ending at (new_end_row, new_end_col). Decorations
+ * after it move with the text; those it cuts into lose the replaced part,
+ * and those left empty are dropped. */
+void decor_note_edit(DecorLayer *layer, int start_row, int start_col,
+                     int old_end_row, int old_end_col,
+                     int new_end_row, int new_end_col);
+
+#endif /* LOKI_DECOR_H */
@@ -0,0 +1,399 @@
+/* diff.c - Line diff by line hashes
+ *
+ * See diff.h. The search is the greedy forward one of Myers' "An O(ND)
+ * Difference Algorithm": V[k] is the furthest x reached on diagonal k
+ * (x - y) with d edits, and the V of every d is kept for the walk back
+ * that marks the lines deleted and inserted.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+
+#define P1 UINT64_C(11400714785074694791)
+#define P2 UINT64_C(14029467366897019727)
+#define P3 UINT64_C(1609587929392839161)
+#define P4 UINT64_C(9650029242287828579)
+#define P5 UINT64_C(2870177450012600261)
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t diff_hash(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    uint64_t h = P5 + (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        uint64_t lane;
+        memcpy(&lane, p, 8);
+        h ^= rotl(lane * P2, 31) * P1;
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t lane;
+        memcpy(&lane, p, 4);
+        h ^= (uint64_t)lane * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Mark in del[] and ins[] the lines of a[0..n) deleted and of b[0..m)
+ * inserted by a shortest edit script. Returns 0, 1 if it takes more than
+ * DIFF_MAX_EDITS edits (nothing marked), or -1 out of memory. */
+static int myers(const uint64_t *a, int n, const uint64_t *b, int m,
+                 char *del, char *ins) {
+    int max = n + m;
+    if (max > DIFF_MAX_EDITS) max = DIFF_MAX_EDITS;
+
+    /* trace + d * d: the V of d, diagonals -d..d */
+    size_t cells = (size_t)(max + 1) * (size_t)(max + 1);
+    int *trace = malloc(sizeof(int) * cells);
+    int *v = malloc(sizeof(int) * (size_t)(2 * max + 3));
+    if (trace == NULL || v == NULL) {
+        free(trace);
+        free(v);
+        errno = ENOMEM;
+        return -1;
+    }
+    int *vk = v + max + 1;          /* vk[k] for k in -max-1..max+1 */
+    vk[1] = 0;
+
+    int found = -1;
+    for (int d = 0; d <= max && found < 0; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vk[k - 1] < vk[k + 1]))
+                ? vk[k + 1] : vk[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            vk[k] = x;
+            if (x >= n && y >= m) found = d;
+        }
+        memcpy(trace + (size_t)d * (size_t)d, vk - d, sizeof(int) * (size_t)(2 * d + 1));
+    }
+    free(v);
+    if (found < 0) {
+        free(trace);
+        return 1;
+    }
+
+    /* Back from (n, m): each d took one edit off the end of a snake */
+    int x = n, y = m;
+    for (int d = found; d > 0; d--) {
+        const int *prev = trace + (size_t)(d - 1) * (size_t)(d - 1) + (d - 1);
+        int k = x - y;
+        int down = k == -d || (k != d && prev[k - 1] < prev[k + 1]);
+        int pk = down ? k + 1 : k - 1;
+        int px = prev[pk], py = px - pk;
+        if (down) ins[py] = 1;
+        else del[px] = 1;
+        x = px;
+        y = py;
+    }
+    free(trace);
+    return 0;
+}
+
+/* Hunks out of the marks of a[0..n) deleted and b[0..m) inserted, lines
+ * a[0] and b[0] being old_start 'pre' and new_start 'pre'. Sets *hunks
+ * and *nhunks, or returns -1 out of memory. */
+static int build_hunks(const char *del, int n, const char *ins, int m, int pre,
+                       DiffHunk **hunks, int *nhunks) {
+    DiffHunk *out = malloc(sizeof(DiffHunk) * ((size_t)(n < m ? n : m) + 1));
+    if (out == NULL) return -1;
+
+    /* Runs of deleted and inserted lines between matched ones */
+    int count = 0, i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && j < m && !del[i] && !ins[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        int i0 = i, j0 = j;
+        while ((i < n && del[i]) || (j < m && ins[j])) {
+            while (i < n && del[i]) i++;
+            while (j < m && ins[j]) j++;
+        }
+        out[count++] = (DiffHunk){ pre + i0, i - i0, pre + j0, j - j0 };
+    }
+    *hunks = out;
+    *nhunks = count;
+    return 0;
+}
+
+/* Lines a[0..*pre) and b[0..*pre) are the same, as are the last *suf */
+static void trim(const uint64_t *a, int na, const uint64_t *b, int nb,
+                 int *pre, int *suf) {
+    int p = 0;
+    while (p < na && p < nb && a[p] == b[p]) p++;
+    int s = 0;
+    while (s < na - p && s < nb - p && a[na - 1 - s] == b[nb - 1 - s]) s++;
+    *pre = p;
+    *suf = s;
+}
+
+int diff_lines(const uint64_t *a, int na, const uint64_t *b, int nb,
+               DiffHunk **hunks, int *nhunks) {
+    *hunks = NULL;
+    *nhunks = 0;
+
+    /* The lines both start and end with */
+    int pre, suf;
+    trim(a, na, b, nb, &pre, &suf);
+    int n = na - pre - suf, m = nb - pre - suf;
+    if (n == 0 && m == 0) return 0;
+
+    char *del = calloc((size_t)n + 1, 1);
+    char *ins = calloc((size_t)m + 1, 1);
+    if (del == NULL || ins == NULL) goto nomem;
+
+    int ret = myers(a + pre, n, b + pre, m, del, ins);
+    if (ret == -1) goto nomem;
+    if (ret == 1) {
+        /* Too different to be worth the search: all of it */
+        memset(del, 1, (size_t)n);
+        memset(ins, 1, (size_t)m);
+    }
+    if (build_hunks(del, n, ins, m, pre, hunks, nhunks) == -1) goto nomem;
+    free(del);
+    free(ins);
+    return 0;
+
+nomem:
+    free(del);
+    free(ins);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* ========================= Histogram diff ========================= */
+
+/* A line of the old text in the histogram of a region: how many times it
+ * occurs there, and the last of them (chained through 'next') */
+typedef struct HistSlot {
+    uint64_t hash;
+    int count;
+    int last;
+    unsigned gen;           /* Slots of other regions are empty */
+} HistSlot;
+
+typedef struct Hist {
+    HistSlot *slot;
+    size_t mask;
+    int *next;              /* next[i]: the occurrence before line i, or -1 */
+    unsigned gen;
+} Hist;
+
+static HistSlot *hist_find(Hist *h, uint64_t hash, int add) {
+    size_t i = (size_t)(hash ^ (hash >> 29)) & h->mask;
+    for (;;) {
+        HistSlot *s = &h->slot[i];
+        if (s->gen != h->gen) {
+            if (!add) return NULL;
+            s->gen = h->gen;
+            s->hash = hash;
+            s->count = 0;
+            s->last = -1;
+            return s;
+        }
+        if (s->hash == hash) return s;
+        i = (i + 1) & h->mask;
+    }
+}
+
+/* A region of both texts still to diff */
+typedef struct Region {
+    int a0, a1, b0, b1;
+} Region;
+
+/* Find in the region the longest run of common lines holding the line
+ * rarest in a[] (git's histogram diff). Returns 1 with the run in *run,
+ * 0 if the common lines are all too frequent, -1 if there are none. */
+static int hist_lcs(Hist *h, const uint64_t *a, const uint64_t *b,
+                    const Region *r, Region *run) {
+    h->gen++;
+    if (h->gen == 0) {
+        /* Wrapped: a stamp might match a slot left long ago */
+        memset(h->slot, 0, sizeof(HistSlot) * (h->mask + 1));
+        h->gen = 1;
+    }
+    for (int i = r->a0; i < r->a1; i++) {
+        HistSlot *s = hist_find(h, a[i], 1);
+        h->next[i] = s->last;
+        s->last = i;
+        s->count++;
+    }
+
+    int common = 0, found = 0;
+    int lowest = DIFF_HIST_MAX_CHAIN + 1;
+    for (int j = r->b0; j < r->b1; ) {
+        HistSlot *s = hist_find(h, b[j], 0);
+        int jnext = j + 1;
+        if (s == NULL) {
+            j = jnext;
+            continue;
+        }
+        common = 1;
+        if (s->count > lowest) {
+            j = jnext;
+            continue;
+        }
+        for (int i = s->last; i != -1; i = h->next[i]) {
+            int as = i, ae = i, bs = j, be = j;
+            int rc = s->count;
+            while (as > r->a0 && bs > r->b0 && a[as - 1] == b[bs - 1]) {
+                as--;
+                bs--;
+                int c = hist_find(h, a[as], 0)->count;
+                if (c < rc) rc = c;
+            }
+            while (ae + 1 < r->a1 && be + 1 < r->b1 && a[ae + 1] == b[be + 1]) {
+                ae++;
+                be++;
+                int c = hist_find(h, a[ae], 0)->count;
+                if (c < rc) rc = c;
+            }
+            if (jnext <= be) jnext = be + 1;
+            if (!found || run->a1 - run->a0 < ae - as + 1 || rc < lowest) {
+                *run = (Region){ as, ae + 1, bs, be + 1 };
+                lowest = rc;
+                found = 1;
+            }
+        }
+        j = jnext;
+    }
+    if (found) return 1;
+    return common ? 0 : -1;
+}
+
+int diff_histogram(const uint64_t *a, int na, const uint64_t *b, int nb,
+                   DiffHunk **hunks, int *nhunks) {
+    *hunks = NULL;
+    *nhunks = 0;
+
+    int pre, suf;
+    trim(a, na, b, nb, &pre, &suf);
+    int n = na - pre - suf, m = nb - pre - suf;
+    if (n == 0 && m == 0) return 0;
+    a += pre;
+    b += pre;
+
+    size_t slots = 16;
+    while (slots < (size_t)n * 2) slots <<= 1;
+    Hist h = { calloc(slots, sizeof(HistSlot)), slots - 1,
+               malloc(sizeof(int) * ((size_t)n + 1)), 0 };
+    char *del = calloc((size_t)n + 1, 1);
+    char *ins = calloc((size_t)m + 1, 1);
+    int cap = 64, depth = 0;
+    Region *stack = malloc(sizeof(Region) * (size_t)cap);
+    if (h.slot == NULL || h.next == NULL || del == NULL || ins == NULL ||
+        stack == NULL) goto nomem;
+
+    /* Regions split around their run, left ones first */
+    stack[depth++] = (Region){ 0, n, 0, m };
+    while (depth > 0) {
+        Region r = stack[--depth];
+        while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a0] == b[r.b0]) {
+            r.a0++;
+            r.b0++;
+        }
+        while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a1 - 1] == b[r.b1 - 1]) {
+            r.a1--;
+            r.b1--;
+        }
+        if (r.a0 == r.a1 || r.b0 == r.b1) {
+            memset(del + r.a0, 1, (size_t)(r.a1 - r.a0));
+            memset(ins + r.b0, 1, (size_t)(r.b1 - r.b0));
+            continue;
+        }
+
+        Region run;
+        int ret = hist_lcs(&h, a, b, &r, &run);
+        if (ret == -1) {
+            /* Nothing in common */
+            memset(del + r.a0, 1, (size_t)(r.a1 - r.a0));
+            memset(ins + r.b0, 1, (size_t)(r.b1 - r.b0));
+            continue;
+        }
+        if (ret == 0) {
+            /* Only lines too common to anchor on: search it all */
+            int mret = myers(a + r.a0, r.a1 - r.a0, b + r.b0, r.b1 - r.b0,
+                             del + r.a0, ins + r.b0);
+            if (mret == -1) goto nomem;
+            if (mret == 1) {
+                memset(del + r.a0, 1, (size_t)(r.a1 - r.a0));
+                memset(ins + r.b0, 1, (size_t)(r.b1 - r.b0));
+            }
+            continue;
+        }
+
+        if (depth + 2 > cap) {
+            cap *= 2;
+            Region *grown = realloc(stack, sizeof(Region) * (size_t)cap);
+            if (grown == NULL) goto nomem;
+            stack = grown;
+        }
+        stack[depth++] = (Region){ run.a1, r.a1, run.b1, r.b1 };
+        stack[depth++] = (Region){ r.a0, run.a0, r.b0, run.b0 };
+    }
+
+    if (build_hunks(del, n, ins, m, pre, hunks, nhunks) == -1) goto nomem;
+    free(h.slot);
+    free(h.next);
+    free(del);
+    free(ins);
+    free(stack);
+    return 0;
+
+nomem:
+    free(h.slot);
+    free(h.next);
+    free(del);
+    free(ins);
+    free(stack);
+    errno = ENOMEM;
+    return -1;
+}
+
+int diff_map_line(const DiffHunk *hunks, int nhunks, int line, int reverse) {
+    /* The last hunk starting at or before the line */
+    int lo = 0, hi = nhunks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int start = reverse ? hunks[mid].new_start : hunks[mid].old_start;
+        if (start <= line) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return line;
+
+    const DiffHunk *h = &hunks[lo - 1];
+    int from = reverse ? h->new_start : h->old_start;
+    int from_count = reverse ? h->new_count : h->old_count;
+    int to = reverse ? h->old_start : h->new_start;
+    int to_count = reverse ? h->old_count : h->new_count;
+    if (line < from + from_count) {
+        int at = line - from;
+        if (at >= to_count) at = to_count > 0 ? to_count - 1 : 0;
+        return to + at;
+    }
+    return line - (from + from_count) + to + to_count;
+}
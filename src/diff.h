@@ -0,0 +1,58 @@
+/* diff.h - Line diff by line hashes
+ *
+ * Each line is hashed once with diff_hash(), a 64-bit hash that takes
+ * eight bytes a round (xxHash64's round and avalanche), and the diff
+ * compares hashes only. The lines both texts start and end with are
+ * trimmed first, which leaves little for the typical change (a checkout
+ * touching a few places, a formatter); Myers' O((N+M)D) search then runs
+ * on the rest. Past DIFF_MAX_EDITS edits the rest is one hunk.
+ *
+ * diff_histogram() is git's histogram diff: the rest is split around the
+ * longest run of common lines holding the line rarest in the old text,
+ * and each side split again, so that unique lines (a function's name, a
+ * key of a config dump) anchor the diff. It takes about one hash lookup
+ * per line and level, however far apart the texts are, where Myers'
+ * search grows with the edits; regions whose common lines all occur more
+ * than DIFF_HIST_MAX_CHAIN times go to Myers'.
+ */
+
+#ifndef LOKI_DIFF_H
+#define LOKI_DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most edits (lines deleted plus lines inserted) searched for: the
+ * search keeps (D + 1)^2 ints */
+#define DIFF_MAX_EDITS 2048
+
+/* Most occurrences of a line the histogram diff anchors on */
+#define DIFF_HIST_MAX_CHAIN 64
+
+/* Lines old_start.. (old_count of them) of the old text became lines
+ * new_start.. (new_count) of the new; either count may be 0. */
+typedef struct DiffHunk {
+    int old_start, old_count;
+    int new_start, new_count;
+} DiffHunk;
+
+/* Hash of the 'len' bytes at 's'. */
+uint64_t diff_hash(const char *s, size_t len);
+
+/* Diff old lines a[0..na) against new lines b[0..nb), as hashes. Sets
+ * *hunks (ascending, free() it) and *nhunks. Returns 0, or -1 with
+ * errno ENOMEM. */
+int diff_lines(const uint64_t *a, int na, const uint64_t *b, int nb,
+               DiffHunk **hunks, int *nhunks);
+
+/* As diff_lines(), by histogram diff: not always the fewest edits, but
+ * fast on long texts far apart, and hunks that keep to unique lines. */
+int diff_histogram(const uint64_t *a, int na, const uint64_t *b, int nb,
+                   DiffHunk **hunks, int *nhunks);
+
+/* The line of the new text that old line 'line' is (with 'reverse', the
+ * old line new line 'line' is). A line the hunks replaced maps to the
+ * line at its place in the replacement, or the last of it. */
+int diff_map_line(const DiffHunk *hunks, int nhunks, int line, int reverse);
+
+#endif /* LOKI_DIFF_H */
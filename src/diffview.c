@@ -0,0 +1,525 @@
+/* diffview.c - :diff between two buffers, or a buffer and its saved file
+ *
+ * See diffview.h for an overview. Each side keeps the hashes of its lines
+ * as they were when the hunks were made, and what the edits since have
+ * touched: the lines before 'head' and the last 'tail' lines are the same
+ * still. The part between, rehashed, and the hunks around it go through
+ * diff_histogram() again; the lines above keep their place and the lines
+ * below move by as many lines as the edits added.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diffview.h"
+#include "decor.h"
+#include "task_pool.h"
+
+typedef struct DiffSide {
+    editor_ctx_t *ctx;
+    uint64_t *hash;         /* Hashes of the lines the hunks were made of */
+    int n;                  /* ... and how many */
+    int rows;               /* Lines now, after the edits since */
+    int head;               /* Lines at the start no edit touched since */
+    int tail;               /* ... and at the end */
+    int edited;
+    int reset;              /* All of the lines are new */
+} DiffSide;
+
+/* A whole diff run on the pool. It reads the hashes of the sides, which
+ * are not spliced meanwhile; a diff ended first leaves them to it. */
+typedef struct DiffJob {
+    DiffView *dv;           /* NULL once the diff has ended */
+    uint64_t *a, *b;
+    int na, nb;
+    DiffHunk *hunks;
+    int nhunks;
+    int result;             /* 0, or -1 out of memory */
+    TaskToken token;
+} DiffJob;
+
+struct DiffView {
+    DiffSide side[2];       /* The old text, and the new */
+    DiffHunk *hunks;
+    int nhunks;
+    DiffJob *job;           /* Running, or NULL */
+    int sync_row, sync_rowoff;  /* The view last put in step, from */
+    editor_ctx_t *sync_from;    /* ... this side */
+};
+
+static void job_free(DiffJob *job) {
+    if (job->dv == NULL) {
+        free(job->a);
+        free(job->b);
+    }
+    free(job->hunks);
+    free(job);
+}
+
+static int side_of(const DiffView *dv, const EditorModel *model) {
+    return &dv->side[0].ctx->model == model ? 0 : 1;
+}
+
+/* Hash rows from..to of a side's buffer into hash[at..] */
+static void hash_rows(const DiffSide *s, uint64_t *hash, int at, int from, int to) {
+    const EditorModel *model = &s->ctx->model;
+    for (int r = from; r < to; r++)
+        hash[at++] = diff_hash(model->row[r].chars, (size_t)model->row[r].size);
+}
+
+/* A buffer of one empty row is an empty text */
+static int text_rows(const editor_ctx_t *ctx) {
+    const EditorModel *model = &ctx->model;
+    if (model->numrows == 1 && model->row[0].size == 0) return 0;
+    return model->numrows;
+}
+
+static void side_clean(DiffSide *s) {
+    s->rows = s->n;
+    s->head = s->n;
+    s->tail = s->n;
+    s->edited = 0;
+    s->reset = 0;
+}
+
+/* Hash all of a side's rows again */
+static void side_rehash(DiffSide *s) {
+    int n = text_rows(s->ctx);
+    uint64_t *hash = realloc(s->hash, sizeof(uint64_t) * ((size_t)n + 1));
+    if (hash == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    s->hash = hash;
+    s->n = n;
+    hash_rows(s, s->hash, 0, 0, n);
+    side_clean(s);
+}
+
+/* ============================ Decorations =============================== */
+
+static void decorate_rows(DiffSide *s, int first, int count, unsigned char hl) {
+    EditorModel *model = &s->ctx->model;
+    for (int r = first; r < first + count && r < model->numrows; r++)
+        editor_decorate(model, DECOR_GROUP_DIFF, r, 0, model->row[r].size, hl);
+}
+
+static void decorate_hunks(DiffView *dv, const DiffHunk *hunks, int nhunks) {
+    for (int i = 0; i < nhunks; i++) {
+        const DiffHunk *h = &hunks[i];
+        decorate_rows(&dv->side[0], h->old_start, h->old_count,
+                      h->new_count ? DIFFVIEW_HL_CHANGED : DIFFVIEW_HL_DELETED);
+        decorate_rows(&dv->side[1], h->new_start, h->new_count,
+                      h->old_count ? DIFFVIEW_HL_CHANGED : DIFFVIEW_HL_ADDED);
+    }
+}
+
+static void decorate_all(DiffView *dv) {
+    for (int i = 0; i < 2; i++) editor_undecorate(&dv->side[i].ctx->model, DECOR_GROUP_DIFF);
+    decorate_hunks(dv, dv->hunks, dv->nhunks);
+    dv->sync_from = NULL;
+}
+
+static void set_hunks(DiffView *dv, DiffHunk *hunks, int nhunks) {
+    free(dv->hunks);
+    dv->hunks = hunks;
+    dv->nhunks = nhunks;
+}
+
+static int update(DiffView *dv);
+
+/* ============================== Whole diffs ============================= */
+
+static void job_run(void *arg) {
+    DiffJob *job = arg;
+    job->result = diff_histogram(job->a, job->na, job->b, job->nb,
+                                 &job->hunks, &job->nhunks);
+}
+
+static void job_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    DiffJob *job = event->data.user.ptr;
+    DiffView *dv = job->dv;
+    if (dv == NULL || event->data.user.i64[0] == 0 || job->result == -1) {
+        if (dv) {
+            dv->job = NULL;
+            editor_set_status_msg(dv->side[1].ctx, "Diff failed: out of memory");
+        }
+        job_free(job);
+        return;
+    }
+    dv->job = NULL;
+    set_hunks(dv, job->hunks, job->nhunks);
+    job->hunks = NULL;
+    job_free(job);
+
+    /* Edited meanwhile: the hunks are of the lines the diff started with */
+    DiffSide *a = &dv->side[0], *b = &dv->side[1];
+    int ret = 0;
+    if (a->edited || b->edited) {
+        ret = update(dv);
+        if (ret == 0 && dv->job == NULL) decorate_all(dv);
+    } else {
+        decorate_all(dv);
+    }
+    if (ret == -1) {
+        editor_ctx_t *ctx = b->ctx;
+        diffview_stop(&ctx->model);
+        editor_set_status_msg(ctx, "Diff ended: out of memory");
+        return;
+    }
+    if (dv->job == NULL)
+        editor_set_status_msg(b->ctx, "%d hunk%s", dv->nhunks,
+                              dv->nhunks == 1 ? "" : "s");
+}
+
+/* Diff all of both sides, on the pool if they are long. Returns 0, or -1
+ * out of memory. */
+static int diff_all(DiffView *dv) {
+    DiffSide *a = &dv->side[0], *b = &dv->side[1];
+    if (a->n + b->n >= DIFFVIEW_ASYNC_LINES) {
+        DiffJob *job = calloc(1, sizeof(DiffJob));
+        if (job == NULL) return -1;
+        job->dv = dv;
+        job->a = a->hash;
+        job->na = a->n;
+        job->b = b->hash;
+        job->nb = b->n;
+        task_token_init(&job->token);
+        if (async_queue_get_handler(NULL, DIFFVIEW_ASYNC_EVENT) != job_event_handler) {
+            async_queue_set_handler(NULL, DIFFVIEW_ASYNC_EVENT, job_event_handler);
+            async_event_set_type_name(DIFFVIEW_ASYNC_EVENT, "diff");
+        }
+        if (task_post(job_run, job, TASK_PRIORITY_HIGH, &job->token,
+                      DIFFVIEW_ASYNC_EVENT) == 0) {
+            dv->job = job;
+            return 0;
+        }
+        free(job);      /* No pool: here, then */
+    }
+
+    DiffHunk *hunks;
+    int nhunks;
+    if (diff_histogram(a->hash, a->n, b->hash, b->n, &hunks, &nhunks) == -1)
+        return -1;
+    set_hunks(dv, hunks, nhunks);
+    decorate_all(dv);
+    return 0;
+}
+
+int diffview_start(editor_ctx_t *old, editor_ctx_t *new_) {
+    if (old == new_) {
+        editor_set_status_msg(new_, "Cannot diff a buffer with itself");
+        return -1;
+    }
+    if (old->model.diff || new_->model.diff) {
+        editor_set_status_msg(new_, "Already in a diff (:diff off ends it)");
+        return -1;
+    }
+    if (old->model.lazy || new_->model.lazy) {
+        editor_set_status_msg(new_, "Cannot diff a file this large");
+        return -1;
+    }
+
+    DiffView *dv = calloc(1, sizeof(DiffView));
+    if (dv == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    dv->side[0].ctx = old;
+    dv->side[1].ctx = new_;
+    side_rehash(&dv->side[0]);
+    side_rehash(&dv->side[1]);
+    old->model.diff = dv;
+    new_->model.diff = dv;
+
+    if (diff_all(dv) == -1) {
+        diffview_stop(&new_->model);
+        editor_set_status_msg(new_, "Cannot diff: out of memory");
+        return -1;
+    }
+    if (dv->job) editor_set_status_msg(new_, "Diffing %d lines...",
+                                       dv->side[0].n + dv->side[1].n);
+    else editor_set_status_msg(new_, "%d hunk%s", dv->nhunks,
+                               dv->nhunks == 1 ? "" : "s");
+    return 0;
+}
+
+void diffview_stop(EditorModel *model) {
+    DiffView *dv = model->diff;
+    if (dv == NULL) return;
+    for (int i = 0; i < 2; i++) {
+        EditorModel *m = &dv->side[i].ctx->model;
+        m->diff = NULL;
+        editor_undecorate(m, DECOR_GROUP_DIFF);
+    }
+    if (dv->job) {
+        /* It frees the hashes it reads once it is done */
+        task_token_cancel(&dv->job->token);
+        dv->job->dv = NULL;
+    } else {
+        free(dv->side[0].hash);
+        free(dv->side[1].hash);
+    }
+    free(dv->hunks);
+    free(dv);
+}
+
+/* ================================ Edits ================================= */
+
+void diffview_note_edit(EditorModel *model, int row, int old_end, int new_end) {
+    DiffView *dv = model->diff;
+    if (dv == NULL) return;
+    DiffSide *s = &dv->side[side_of(dv, model)];
+    if (row < s->head) s->head = row;
+    int after = s->rows - 1 - old_end;
+    if (after < s->tail) s->tail = after < 0 ? 0 : after;
+    s->rows += new_end - old_end;
+    s->edited = 1;
+}
+
+void diffview_note_reset(EditorModel *model) {
+    DiffView *dv = model->diff;
+    if (dv == NULL) return;
+    DiffSide *s = &dv->side[side_of(dv, model)];
+    s->edited = 1;
+    s->reset = 1;
+}
+
+/* A point where the texts align: line x of the old is line y of the new,
+ * and the lines just before, if any, are in step or end a hunk. Stretch k
+ * is the lines in step after hunk k-1 (from the start for k = 0). */
+static void stretch(const DiffView *dv, int k, int *x, int *y, int *len) {
+    const DiffHunk *h = dv->hunks;
+    *x = k ? h[k - 1].old_start + h[k - 1].old_count : 0;
+    *y = k ? h[k - 1].new_start + h[k - 1].new_count : 0;
+    int end = k < dv->nhunks ? h[k].old_start : dv->side[0].n;
+    *len = end - *x;
+}
+
+/* Rediff the part of both sides the edits touched, between the points
+ * they align on around it */
+static int diff_edited(DiffView *dv) {
+    DiffSide *a = &dv->side[0], *b = &dv->side[1];
+
+    /* The edited lines of each side, in the lines the hunks were made of */
+    int lo[2], hi[2];
+    for (int i = 0; i < 2; i++) {
+        DiffSide *s = &dv->side[i];
+        lo[i] = s->edited ? s->head : INT_MAX;
+        hi[i] = s->edited ? s->n - s->tail : 0;
+        if (s->edited && hi[i] < lo[i]) hi[i] = lo[i];
+    }
+
+    /* The last stretch starting at or before both, and the point in it */
+    int first = 0, last = dv->nhunks;
+    while (first < last) {
+        int mid = first + (last - first + 1) / 2, x, y, len;
+        stretch(dv, mid, &x, &y, &len);
+        if (x <= lo[0] && y <= lo[1]) first = mid;
+        else last = mid - 1;
+    }
+    int ks = first, x0, y0, len;
+    stretch(dv, ks, &x0, &y0, &len);
+    int t = len;
+    if (lo[0] - x0 < t) t = lo[0] - x0;
+    if (lo[1] - y0 < t) t = lo[1] - y0;
+    x0 += t;
+    y0 += t;
+
+    /* The first stretch ending at or after both, and the point in it */
+    first = ks;
+    last = dv->nhunks;
+    while (first < last) {
+        int mid = first + (last - first) / 2, x, y;
+        stretch(dv, mid, &x, &y, &len);
+        if (x + len >= hi[0] && y + len >= hi[1]) last = mid;
+        else first = mid + 1;
+    }
+    int ke = first, x1, y1;
+    stretch(dv, ke, &x1, &y1, &len);
+    t = 0;
+    if (hi[0] - x1 > t) t = hi[0] - x1;
+    if (hi[1] - y1 > t) t = hi[1] - y1;
+    if (ke == ks) {
+        /* In one stretch: the end no earlier than the start */
+        if (x0 - x1 > t) t = x0 - x1;
+    }
+    x1 += t;
+    y1 += t;
+
+    /* The edited lines hashed in place of the old */
+    int grow[2] = { a->rows - a->n, b->rows - b->n };
+    for (int i = 0; i < 2; i++) {
+        DiffSide *s = &dv->side[i];
+        if (!s->edited) continue;
+        int from = s->head, old_end = s->n - s->tail, new_end = s->rows - s->tail;
+        if (old_end < from) old_end = from;
+        if (new_end < from) new_end = from;
+        if (s->rows > s->n) {
+            uint64_t *hash = realloc(s->hash, sizeof(uint64_t) * ((size_t)s->rows + 1));
+            if (hash == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+            s->hash = hash;
+        }
+        memmove(s->hash + new_end, s->hash + old_end,
+                sizeof(uint64_t) * (size_t)(s->n - old_end));
+        hash_rows(s, s->hash, from, from, new_end);
+        s->n = s->rows;
+    }
+
+    int an = x1 + grow[0] - x0, bn = y1 + grow[1] - y0;
+    DiffHunk *part;
+    int nparts;
+    if (diff_histogram(a->hash + x0, an, b->hash + y0, bn, &part, &nparts) == -1)
+        return -1;
+
+    /* Hunks before, the new ones, and those after moved */
+    int nafter = dv->nhunks - ke;
+    int total = ks + nparts + nafter;
+    DiffHunk *hunks = malloc(sizeof(DiffHunk) * ((size_t)total + 1));
+    if (hunks == NULL) {
+        free(part);
+        return -1;
+    }
+    if (ks) memcpy(hunks, dv->hunks, sizeof(DiffHunk) * (size_t)ks);
+    for (int i = 0; i < nparts; i++) {
+        part[i].old_start += x0;
+        part[i].new_start += y0;
+        hunks[ks + i] = part[i];
+    }
+    for (int i = 0; i < nafter; i++) {
+        DiffHunk h = dv->hunks[ke + i];
+        h.old_start += grow[0];
+        h.new_start += grow[1];
+        hunks[ks + nparts + i] = h;
+    }
+    free(dv->hunks);
+    dv->hunks = hunks;
+    dv->nhunks = total;
+
+    /* The decorations of the part again */
+    if (an > 0) editor_undecorate_rows(&a->ctx->model, DECOR_GROUP_DIFF, x0, x0 + an - 1);
+    if (bn > 0) editor_undecorate_rows(&b->ctx->model, DECOR_GROUP_DIFF, y0, y0 + bn - 1);
+    decorate_hunks(dv, part, nparts);
+    free(part);
+
+    side_clean(a);
+    side_clean(b);
+    return 0;
+}
+
+/* Diff again what the edits changed. Returns 0, or -1 out of memory. */
+static int update(DiffView *dv) {
+    /* Rows the notes do not account for: an empty buffer typed in */
+    for (int i = 0; i < 2; i++) {
+        DiffSide *s = &dv->side[i];
+        if (s->edited && s->rows != text_rows(s->ctx)) s->reset = 1;
+    }
+    if (dv->side[0].reset || dv->side[1].reset) {
+        /* Read again: all of it */
+        side_rehash(&dv->side[0]);
+        side_rehash(&dv->side[1]);
+        return diff_all(dv);
+    }
+    return diff_edited(dv);
+}
+
+/* Put the other side's view on the lines matching 'ctx' */
+static void sync_view(DiffView *dv, editor_ctx_t *ctx) {
+    int from = side_of(dv, &ctx->model);
+    editor_ctx_t *other = dv->side[!from].ctx;
+    int row = ctx->view.rowoff + ctx->view.cy;
+    if (dv->sync_from == ctx && dv->sync_row == row &&
+        dv->sync_rowoff == ctx->view.rowoff) return;
+    dv->sync_from = ctx;
+    dv->sync_row = row;
+    dv->sync_rowoff = ctx->view.rowoff;
+
+    int numrows = other->model.numrows;
+    if (numrows == 0) return;
+    int reverse = from == 1;
+    int to = diff_map_line(dv->hunks, dv->nhunks, row, reverse);
+    int rowoff = diff_map_line(dv->hunks, dv->nhunks, ctx->view.rowoff, reverse);
+    if (to >= numrows) to = numrows - 1;
+    if (rowoff > to) rowoff = to;
+    if (other->view.screenrows > 0 && to - rowoff >= other->view.screenrows)
+        rowoff = to - other->view.screenrows + 1;
+    other->view.rowoff = rowoff;
+    other->view.cy = to - rowoff;
+    other->view.coloff = ctx->view.coloff;
+    other->view.cx = ctx->view.cx;
+    int size = other->model.row[to].size;
+    if (other->view.coloff + other->view.cx > size) {
+        other->view.coloff = 0;
+        other->view.cx = size;
+        if (other->view.screencols > 0 && size >= other->view.screencols) {
+            other->view.coloff = size - other->view.screencols + 1;
+            other->view.cx = other->view.screencols - 1;
+        }
+    }
+}
+
+int diffview_tick(editor_ctx_t *ctx) {
+    DiffView *dv = ctx->model.diff;
+    if (dv == NULL) return -1;
+
+    if (dv->job == NULL && (dv->side[0].edited || dv->side[1].edited)) {
+        if (update(dv) == -1) {
+            diffview_stop(&ctx->model);
+            editor_set_status_msg(ctx, "Diff ended: out of memory");
+            return -1;
+        }
+    }
+    sync_view(dv, ctx);
+    return -1;
+}
+
+int diffview_jump(editor_ctx_t *ctx, int dir) {
+    DiffView *dv = ctx->model.diff;
+    if (dv == NULL) {
+        editor_set_status_msg(ctx, "Not in a diff");
+        return -1;
+    }
+    diffview_tick(ctx);
+    if (ctx->model.diff == NULL) return -1;
+    int side = side_of(dv, &ctx->model);
+    int row = ctx->view.rowoff + ctx->view.cy;
+
+    /* The first hunk starting after the cursor, or the last before it */
+    int target = -1;
+    for (int lo = 0, hi = dv->nhunks; lo < hi; ) {
+        int mid = lo + (hi - lo) / 2;
+        int start = side ? dv->hunks[mid].new_start : dv->hunks[mid].old_start;
+        if (dir > 0 ? start > row : start < row) {
+            if (dir > 0) hi = mid;
+            else lo = mid + 1;
+            target = mid;
+        } else if (dir > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (target == -1) {
+        editor_set_status_msg(ctx, dir > 0 ? "No hunk below" : "No hunk above");
+        return -1;
+    }
+    const DiffHunk *h = &dv->hunks[target];
+    int to = side ? h->new_start : h->old_start;
+    if (to >= ctx->model.numrows) to = ctx->model.numrows - 1;
+    editor_cursor_to(ctx, to < 0 ? 0 : to, 0);
+    editor_set_status_msg(ctx, "Hunk %d of %d", target + 1, dv->nhunks);
+    return 0;
+}
+
+int diffview_hunks(EditorModel *model, const DiffHunk **hunks) {
+    DiffView *dv = model->diff;
+    if (dv == NULL) return -1;
+    *hunks = dv->hunks;
+    return dv->nhunks;
+}
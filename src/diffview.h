@@ -0,0 +1,70 @@
+/* diffview.h - :diff between two buffers, or a buffer and its saved file
+ *
+ * diffview_start() pairs two buffers: the old text and the new one. The
+ * rows of both are hashed (diff_hash()) and diffed (diff_histogram()), and
+ * the lines that differ are decorated in DECOR_GROUP_DIFF on each side:
+ * DIFFVIEW_HL_DELETED for lines only the old text has, DIFFVIEW_HL_ADDED
+ * for lines only the new one has, DIFFVIEW_HL_CHANGED for lines replaced.
+ * With DIFFVIEW_ASYNC_LINES lines or more the diff runs on the task pool,
+ * and the decorations come when it is done.
+ *
+ * Edits to either buffer are noted as they are made (diffview_note_edit(),
+ * from the edit paths of core.c): only the lines before the first edited
+ * one and after the last are known to be unchanged. diffview_tick(), run
+ * by the main loop, rehashes the edited rows and diffs again only the part
+ * between the nearest lines the two texts still align on around them,
+ * usually the one hunk edited, splicing the result between the hunks
+ * before and after.
+ *
+ * The buffers are shown one at a time, so scrolling is kept in step
+ * rather than side by side: each tick puts the other buffer's view and
+ * cursor on the lines that match the current buffer's.
+ */
+
+#ifndef LOKI_DIFFVIEW_H
+#define LOKI_DIFFVIEW_H
+
+#include "async_queue.h"
+#include "diff.h"
+#include "internal.h"
+
+/* Lines of both texts from which a whole diff runs on the task pool */
+#define DIFFVIEW_ASYNC_LINES 20000
+
+/* Event a diff run on the pool reports back with */
+#define DIFFVIEW_ASYNC_EVENT (ASYNC_EVENT_USER + 7)
+
+/* Decoration styles */
+#define DIFFVIEW_HL_DELETED HL_COMMENT
+#define DIFFVIEW_HL_ADDED   HL_KEYWORD2
+#define DIFFVIEW_HL_CHANGED HL_MATCH
+
+typedef struct DiffView DiffView;
+
+/* Diff 'old' against 'new', two buffers not in a diff already. Returns 0,
+ * or -1 with the reason in the status of 'new'. */
+int diffview_start(editor_ctx_t *old, editor_ctx_t *new_);
+
+/* End the diff the buffer is in, removing the decorations from both.
+ * Safe on a model not in one. */
+void diffview_stop(EditorModel *model);
+
+/* Rows row..old_end of the buffer became rows row..new_end. */
+void diffview_note_edit(EditorModel *model, int row, int old_end, int new_end);
+
+/* The buffer's rows were all replaced (read again from its file). */
+void diffview_note_reset(EditorModel *model);
+
+/* Bring the diff 'ctx' is in up to date with its edits, and the other
+ * buffer's view in step with it. Returns -1: it has no timers. */
+int diffview_tick(editor_ctx_t *ctx);
+
+/* Put the cursor on the start of the next hunk (dir > 0) or the previous
+ * one. Returns 0, or -1 if there is none that way. */
+int diffview_jump(editor_ctx_t *ctx, int dir);
+
+/* The hunks of the diff the model is in. Returns their number, or -1 if
+ * it is in none. While a diff on the pool runs they are the last made. */
+int diffview_hunks(EditorModel *model, const DiffHunk **hunks);
+
+#endif /* LOKI_DIFFVIEW_H */
@@ -13,6 +13,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <time.h>
+#include <uv.h>
 
 /* Lua headers */
 #include <lua.h>
@@ -31,7 +32,37 @@
 #include "lang_bridge.h"
 #include "live_loop.h"
 #include "async_queue.h"
-#include "shared/context.h"
+#include "frame_pacer.h"
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "grep.h"
+#include "lua_worker.h"
+#include "task_pool.h"
+#include "idle.h"
+#include "lua_profile.h"
+#include "lua_gc.h"
+#include "lua_cache.h"
+#include "recovery.h"
+#include "session_file.h"
+#include "preview.h"
+#include "follow.h"
+#include "reload.h"
+#include "diffview.h"
+#include "filter.h"
+#include "job.h"
+#include "lsp.h"
+#include "changes.h"
+#include "autocmd.h"
+#include "spell.h"
+#include "symbols.h"
+#include "finder.h"
+#include "trace.h"
+#include "memstats.h"
+#include "startup.h"
+#include "renderer.h"
+#ifdef LOKI_ENABLE_HTTP
+#include "http.h"
+#endif
 
 #ifdef LOKI_USE_LINENOISE
 #include "treesitter.h"
@@ -44,6 +75,47 @@
 
 /* ======================== Helper Functions =============================== */
 
+/* Longest the main loop sleeps while something has to be polled: live
+ * loops, language callbacks, HTTP requests, or input when the event loop
+ * is unavailable. */
+#define EDITOR_IDLE_TICK_MS 100
+
+/* Time async event handlers get per pass of the main loop; events left
+ * over are handled next pass, after input */
+#define EDITOR_DISPATCH_BUDGET_NS 4000000
+
+/* HTTP transfers run from libuv handles; without the event loop they are
+ * polled, quickly */
+#define EDITOR_HTTP_TICK_MS 10
+
+static editor_ctx_t *current_buffer_or_die(void) {
+    editor_ctx_t *ctx = buffer_get_current();
+    if (!ctx) {
+        fprintf(stderr, "Error: No active buffer\n");
+        exit(1);
+    }
+    return ctx;
+}
+
+/* Does the main loop have work that is polled rather than signalled? */
+static int editor_needs_tick(void) {
+    return !event_loop_active() || live_loop_any_active() ||
+           loki_lang_has_callbacks();
+}
+
+/* Wait up to timeout_ms (-1: no limit) for something to do. Returns 1 if
+ * input is ready to read; 0 when woken for anything else. */
+static int editor_wait_input(int timeout_ms) {
+#ifdef LOKI_ENABLE_HTTP
+    if (!event_loop_active() && loki_http_pending_count() > 0 &&
+        (timeout_ms < 0 || timeout_ms > EDITOR_HTTP_TICK_MS))
+        timeout_ms = EDITOR_HTTP_TICK_MS;
+#endif
+    if (!event_loop_active())
+        return terminal_wait_input(STDIN_FILENO, timeout_ms) > 0;
+    return (event_loop_wait(timeout_ms) & EVENT_LOOP_INPUT) != 0;
+}
+
 /* Lua status reporter - reports Lua errors to editor status bar */
 static void loki_lua_status_reporter(const char *message, void *userdata) {
     editor_ctx_t *ctx = (editor_ctx_t *)userdata;
@@ -102,87 +174,176 @@ static void exec_lua_command(editor_ctx_t *ctx, int fd) {
     }
 }
 
-/* Apply Lua-based highlighting spans to a row */
-static int lua_apply_span_table(editor_ctx_t *ctx, t_erow *row, int table_index) {
-    if (!ctx || !ctx_L(ctx)) return 0;
-    lua_State *L = ctx_L(ctx);
-    if (!lua_istable(L, table_index)) return 0;
+/* Results of the Lua highlight hook, cached by row content so unchanged
+ * rows never re-enter Lua. Direct-mapped: a slot holds the last result
+ * that hashed to it. Results depend on the row's text only (not its
+ * index), and the cache is dropped when the hook function changes. */
+#define HL_HOOK_CACHE_SLOTS 4096
+
+typedef struct HookSpan {
+    int start, stop;            /* 1-based, inclusive, start <= stop */
+    int style;
+} HookSpan;
+
+typedef struct HookResult {
+    uint64_t key;               /* 0: empty slot */
+    int replace;
+    int nspans;
+    HookSpan *spans;
+} HookResult;
+
+struct HighlightHookCache {
+    const void *fn;             /* Hook function the results came from */
+    HookResult slots[HL_HOOK_CACHE_SLOTS];
+};
+
+static void hook_cache_clear(struct HighlightHookCache *cache) {
+    for (int i = 0; i < HL_HOOK_CACHE_SLOTS; i++) {
+        free(cache->slots[i].spans);
+        memset(&cache->slots[i], 0, sizeof(cache->slots[i]));
+    }
+}
 
-    int applied = 0;
-    size_t entries = lua_rawlen(L, table_index);
+void lua_highlight_cache_free(LuaHost *host) {
+    if (!host || !host->hl_cache) return;
+    hook_cache_clear(host->hl_cache);
+    free(host->hl_cache);
+    host->hl_cache = NULL;
+}
 
-    for (size_t i = 1; i <= entries; i++) {
-        lua_rawgeti(L, table_index, (lua_Integer)i);
-        if (lua_type(L, -1) == LUA_TTABLE) {
-            int start = 0;
-            int stop = 0;
-            int length = 0;
-            int style = -1;
+static uint64_t hook_key_mix(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
 
-            lua_getfield(L, -1, "start");
-            if (lua_isnumber(L, -1)) start = (int)lua_tointeger(L, -1);
-            lua_pop(L, 1);
+/* Content hash of everything the hook is passed except the row index */
+static uint64_t hook_row_key(const t_erow *row, int syntax_type, int default_ran) {
+    int args[4] = { row->size, row->rsize, syntax_type, default_ran };
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    h = hook_key_mix(h, args, sizeof(args));
+    if (row->chars) h = hook_key_mix(h, row->chars, (size_t)row->size);
+    if (row->render) h = hook_key_mix(h, row->render, (size_t)row->rsize);
+    return h ? h : 1;
+}
 
-            lua_getfield(L, -1, "stop");
-            if (lua_isnumber(L, -1)) stop = (int)lua_tointeger(L, -1);
-            lua_pop(L, 1);
+/* Style of a span field: a name ("keyword1") or an HL_* number; -1 if none */
+static int lua_span_style(lua_State *L, const char *field) {
+    int style = -1;
+    lua_getfield(L, -1, field);
+    if (lua_isstring(L, -1) && !lua_isnumber(L, -1)) {
+        style = syntax_name_to_code(lua_tostring(L, -1));
+    } else if (lua_isnumber(L, -1)) {
+        style = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return style;
+}
 
-            lua_getfield(L, -1, "end");
-            if (lua_isnumber(L, -1)) stop = (int)lua_tointeger(L, -1);
-            lua_pop(L, 1);
+static int lua_span_int(lua_State *L, const char *field, int value) {
+    lua_getfield(L, -1, field);
+    if (lua_isnumber(L, -1)) value = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
 
-            lua_getfield(L, -1, "length");
-            if (lua_isnumber(L, -1)) length = (int)lua_tointeger(L, -1);
-            lua_pop(L, 1);
+/* Read a hook result (nil, or a table with 'replace' and spans either in
+ * 'spans' or in the table itself) at 'index' into *out. Returns 0, or -1
+ * out of memory. */
+static int lua_read_hook_result(lua_State *L, int index, HookResult *out) {
+    out->replace = 0;
+    out->nspans = 0;
+    out->spans = NULL;
+    if (!lua_istable(L, index)) return 0;
+
+    lua_getfield(L, index, "replace");
+    if (lua_isboolean(L, -1)) out->replace = lua_toboolean(L, -1);
+    lua_pop(L, 1);
 
-            lua_getfield(L, -1, "style");
-            if (lua_isstring(L, -1)) {
-                style = syntax_name_to_code(lua_tostring(L, -1));
-            } else if (lua_isnumber(L, -1)) {
-                style = (int)lua_tointeger(L, -1);
-            }
+    lua_getfield(L, index, "spans");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, index);
+    }
+    int spans = lua_gettop(L);
+    size_t entries = lua_rawlen(L, spans);
+    if (entries > 0) {
+        out->spans = malloc(entries * sizeof(HookSpan));
+        if (!out->spans) {
             lua_pop(L, 1);
+            return -1;
+        }
+    }
 
-            if (style < 0) {
-                lua_getfield(L, -1, "type");
-                if (lua_isstring(L, -1)) {
-                    style = syntax_name_to_code(lua_tostring(L, -1));
-                } else if (lua_isnumber(L, -1)) {
-                    style = (int)lua_tointeger(L, -1);
-                }
-                lua_pop(L, 1);
-            }
+    for (size_t i = 1; i <= entries; i++) {
+        lua_rawgeti(L, spans, (lua_Integer)i);
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            int start = lua_span_int(L, "start", 0);
+            int stop = lua_span_int(L, "end", lua_span_int(L, "stop", 0));
+            int length = lua_span_int(L, "length", 0);
+            int style = lua_span_style(L, "style");
+            if (style < 0) style = lua_span_style(L, "type");
 
             if (start <= 0) start = 1;
             if (length > 0 && stop <= 0) stop = start + length - 1;
             if (stop <= 0) stop = start;
-
-            if (style >= 0 && row->rsize > 0) {
-                if (start > stop) {
-                    int tmp = start;
-                    start = stop;
-                    stop = tmp;
-                }
-                if (start < 1) start = 1;
-                if (stop > row->rsize) stop = row->rsize;
-                for (int pos = start - 1; pos < stop && pos < row->rsize; pos++) {
-                    row->hl[pos] = style;
-                }
-                applied = 1;
-            } else if (style >= 0 && row->rsize == 0) {
-                applied = 1;
+            if (start > stop) {
+                int tmp = start;
+                start = stop;
+                stop = tmp;
+            }
+            if (start < 1) start = 1;
+            if (style >= 0) {
+                HookSpan span = { start, stop, style };
+                out->spans[out->nspans++] = span;
             }
         }
         lua_pop(L, 1);
     }
+    lua_pop(L, 1);
+    return 0;
+}
 
-    return applied;
+static void apply_hook_result(t_erow *row, const HookResult *res) {
+    if (!res->replace && res->nspans == 0) return;
+    unsigned char *hl = editor_row_hl(row);
+    if (hl == NULL) return;
+    if (res->replace) memset(hl, HL_NORMAL, row->rsize);
+    for (int i = 0; i < res->nspans; i++) {
+        int stop = res->spans[i].stop;
+        if (stop > row->rsize) stop = row->rsize;
+        for (int pos = res->spans[i].start - 1; pos < stop; pos++)
+            hl[pos] = res->spans[i].style;
+    }
 }
 
-/* Apply Lua custom highlighting to a row */
-static void lua_apply_highlight_row(editor_ctx_t *ctx, t_erow *row, int default_ran) {
-    if (!ctx || !ctx_L(ctx) || row == NULL || row->render == NULL) return;
+/* Store a result read from the Lua stack at 'index' in 'slot' and apply
+ * it to the row. */
+static void lua_take_hook_result(lua_State *L, int index, HookResult *slot,
+                                 uint64_t key, t_erow *row) {
+    free(slot->spans);
+    slot->spans = NULL;
+    slot->key = 0;
+    if (lua_read_hook_result(L, index, slot) != 0) return;
+    slot->key = key;
+    apply_hook_result(row, slot);
+}
+
+/* Row hook (see syntax_set_row_hook()) running loki.highlight_rows, or
+ * loki.highlight_row once per row when only that is defined, for the rows
+ * of [first, last) whose result is not cached.
+ *
+ *   loki.highlight_rows(rows, syntax_type, default_applied)
+ *
+ * gets an array of { idx = row_index, text = line_text, render = render }
+ * and returns an array of results in the same order, each what
+ * loki.highlight_row would return for that row. */
+void lua_highlight_rows(editor_ctx_t *ctx, int first, int last) {
     lua_State *L = ctx_L(ctx);
+    if (!L) return;
     int top = lua_gettop(L);
 
     lua_getglobal(L, "loki");
@@ -190,75 +351,143 @@ static void lua_apply_highlight_row(editor_ctx_t *ctx, t_erow *row, int default_
         lua_settop(L, top);
         return;
     }
-
-    lua_getfield(L, -1, "highlight_row");
+    int batched = 1;
+    lua_getfield(L, -1, "highlight_rows");
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "highlight_row");
+        batched = 0;
+    }
     if (!lua_isfunction(L, -1)) {
         lua_settop(L, top);
         return;
     }
-
-    lua_pushinteger(L, row->idx);
-    lua_pushlstring(L, row->chars ? row->chars : "", (size_t)row->size);
-    lua_pushlstring(L, row->render ? row->render : "", (size_t)row->rsize);
-    if (ctx->view.syntax) {
-        lua_pushinteger(L, ctx->view.syntax->type);
-    } else {
-        lua_pushnil(L);
+    int fn = lua_gettop(L);
+
+    LuaHost *host = ctx->lua_host;
+    if (!host->hl_cache) {
+        host->hl_cache = calloc(1, sizeof(*host->hl_cache));
+        if (!host->hl_cache) {
+            lua_settop(L, top);
+            return;
+        }
     }
-    lua_pushboolean(L, default_ran);
-
-    if (lua_pcall(L, 5, 1, 0) != LUA_OK) {
-        const char *err = lua_tostring(L, -1);
-        editor_set_status_msg(ctx, "Lua highlight error: %s", err ? err : "unknown");
-        lua_settop(L, top);
-        return;
+    struct HighlightHookCache *cache = host->hl_cache;
+    if (cache->fn != lua_topointer(L, fn)) {
+        hook_cache_clear(cache);
+        cache->fn = lua_topointer(L, fn);
     }
 
-    if (!lua_istable(L, -1)) {
+    int syntax_type = ctx->view.syntax ? ctx->view.syntax->type : -1;
+    int default_ran = ctx->view.syntax != NULL;
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) default_ran = 1;
+#endif
+
+    /* Apply cached results; the rest go to Lua */
+    int *missed = malloc((size_t)(last - first) * sizeof(int));
+    if (!missed) {
         lua_settop(L, top);
         return;
     }
+    int misses = 0;
+    lua_newtable(L);
+    int rows = lua_gettop(L);
+    for (int r = first; r < last; r++) {
+        t_erow *row = &ctx->model.row[r];
+        uint64_t key = hook_row_key(row, syntax_type, default_ran);
+        HookResult *slot = &cache->slots[key & (HL_HOOK_CACHE_SLOTS - 1)];
+        if (slot->key == key) {
+            apply_hook_result(row, slot);
+            continue;
+        }
 
-    int table_index = lua_gettop(L);
-    int replace = 0;
-
-    lua_getfield(L, table_index, "replace");
-    if (lua_isboolean(L, -1)) replace = lua_toboolean(L, -1);
-    lua_pop(L, 1);
-
-    int spans_index = table_index;
-    int has_spans_field = 0;
-
-    lua_getfield(L, table_index, "spans");
-    if (lua_istable(L, -1)) {
-        spans_index = lua_gettop(L);
-        has_spans_field = 1;
-    } else {
-        lua_pop(L, 1);
-    }
+        if (!batched) {
+            lua_pushvalue(L, fn);
+            lua_pushinteger(L, r);
+            lua_pushlstring(L, row->chars ? row->chars : "", (size_t)row->size);
+            lua_pushlstring(L, row->render ? row->render : "", (size_t)row->rsize);
+            if (ctx->view.syntax) lua_pushinteger(L, syntax_type);
+            else lua_pushnil(L);
+            lua_pushboolean(L, default_ran);
+            if (lua_profile_pcall(L, LUA_PROFILE_HIGHLIGHT, 5, 1) != LUA_OK) {
+                const char *err = lua_tostring(L, -1);
+                editor_set_status_msg(ctx, "Lua highlight error: %s", err ? err : "unknown");
+                break;
+            }
+            lua_take_hook_result(L, lua_gettop(L), slot, key, row);
+            lua_pop(L, 1);
+            continue;
+        }
 
-    if (replace) {
-        memset(row->hl, HL_NORMAL, row->rsize);
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, r);
+        lua_setfield(L, -2, "idx");
+        lua_pushlstring(L, row->chars ? row->chars : "", (size_t)row->size);
+        lua_setfield(L, -2, "text");
+        lua_pushlstring(L, row->render ? row->render : "", (size_t)row->rsize);
+        lua_setfield(L, -2, "render");
+        lua_rawseti(L, rows, misses + 1);
+        missed[misses++] = r;
     }
 
-    lua_apply_span_table(ctx, row, spans_index);
-
-    if (has_spans_field) {
-        lua_pop(L, 1);
+    if (misses > 0) {
+        lua_pushvalue(L, fn);
+        lua_pushvalue(L, rows);
+        if (ctx->view.syntax) lua_pushinteger(L, syntax_type);
+        else lua_pushnil(L);
+        lua_pushboolean(L, default_ran);
+        if (lua_profile_pcall(L, LUA_PROFILE_HIGHLIGHT, 3, 1) != LUA_OK) {
+            const char *err = lua_tostring(L, -1);
+            editor_set_status_msg(ctx, "Lua highlight error: %s", err ? err : "unknown");
+        } else if (lua_istable(L, -1)) {
+            int results = lua_gettop(L);
+            for (int k = 0; k < misses; k++) {
+                t_erow *row = &ctx->model.row[missed[k]];
+                uint64_t key = hook_row_key(row, syntax_type, default_ran);
+                lua_rawgeti(L, results, k + 1);
+                lua_take_hook_result(L, lua_gettop(L),
+                                     &cache->slots[key & (HL_HOOK_CACHE_SLOTS - 1)],
+                                     key, row);
+                lua_pop(L, 1);
+            }
+        }
     }
 
+    free(missed);
     lua_settop(L, top);
 }
 
 /* ======================== Main Editor Function =========================== */
 
+/* --startup-time: where the time to the first frame went, by phase, and
+ * what was initialized on first use on the way. Run it twice to compare a
+ * cold start (Lua compiled from source) with a warm one (Lua loaded from
+ * the bytecode cache). */
+static void report_startup(void) {
+    LuaCacheStats cache;
+    lua_cache_get_stats(&cache);
+    printf("startup: %.2f ms to the first frame (%s)\n", (double)startup_total_ns() / 1e6,
+           cache.misses ? "cold: Lua compiled from source" : "warm: Lua from the bytecode cache");
+    startup_print(stdout);
+    printf("lua chunks: %.2f ms loading, %u cached, %u compiled, %u stored\n",
+           (double)cache.load_ns / 1e6, cache.hits, cache.misses, cache.stores);
+}
+
 static void print_usage(void) {
-    printf("Usage: " LOKI_NAME " [options] <filename>\n");
+    printf("Usage: " LOKI_NAME " [options] <filename> [<filename>...]\n");
+    printf("       " LOKI_NAME " --session FILE [<filename>...]\n");
     printf("\nOptions:\n");
     printf("  -h, --help          Show this help message\n");
     printf("  -v, --version       Show version information\n");
+    printf("  --startup-time      Start up, report where the time went, and exit\n");
+    printf("  --record-keys FILE  Record the keys typed to FILE (see bench_replay)\n");
+    printf("  --follow            Follow the first file as it grows, like tail -f\n");
+    printf("  --view              Show the first file read-only, a window at a time\n");
+    printf("  --session FILE      Open the buffers of a session, and save it at exit\n");
     printf("\nExamples:\n");
     printf("  " LOKI_NAME " file.txt         Open file in editor\n");
+    printf("  " LOKI_NAME " *.c              Open each file in a buffer of its own\n");
     printf("\nKeybindings:\n");
     printf("  Ctrl-S    Save file\n");
     printf("  Ctrl-Q    Quit\n");
@@ -273,19 +502,38 @@ int loki_editor_main(int argc, char **argv) {
      * may access these fields before buffers_init() runs. */
     static editor_ctx_t E;
 
-    /* Initialize language bridge system */
+    /* Time the phases of startup, for --startup-time */
+    startup_begin();
+
+    /* Memory accounting, if LOKI_MEMSTATS is set; first, to see it all */
+    memstats_start_from_env();
+
+    /* Initialize language bridge system. The languages registered are
+     * initialized on first use. */
     loki_lang_init();
+    startup_mark("language bridge");
 
     /* Initialize async event queue */
     if (async_queue_init() != 0) {
         fprintf(stderr, "Warning: Failed to initialize async event queue\n");
     }
+    startup_mark("async queue");
 
     /* Register cleanup handler early to ensure terminal is always restored */
     atexit(editor_atexit);
 
-    /* Parse command-line arguments */
+    /* Keystroke latency tracing, if LOKI_TRACE names a file */
+    trace_start_from_env();
+
+    /* Parse command-line arguments. Files after the first open in
+     * buffers of their own, read in the background. */
     const char *filename = NULL;
+    int first_extra = 0, extra = 0, missing = 0;
+    int startup_time = 0;
+    int follow = 0;
+    int view = 0;
+    const char *session = NULL;
+    int gone = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
@@ -296,41 +544,89 @@ int loki_editor_main(int argc, char **argv) {
             printf(LOKI_NAME " %s\n", LOKI_VERSION);
             exit(0);
         }
+        if (strcmp(argv[i], "--startup-time") == 0) {
+            startup_time = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--follow") == 0) {
+            follow = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--view") == 0) {
+            view = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--record-keys") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --record-keys requires a file argument\n");
+                exit(1);
+            }
+            if (terminal_record_keys(argv[++i]) != 0) {
+                perror(argv[i]);
+                exit(1);
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--session") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --session requires a file argument\n");
+                exit(1);
+            }
+            session = argv[++i];
+            /* A new one is started if it does not exist */
+            if (access(session, F_OK) == 0 && !session_file_is_session(session)) {
+                fprintf(stderr, "Error: %s is not a session file\n", session);
+                exit(1);
+            }
+            continue;
+        }
         if (argv[i][0] == '-') {
             fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
             print_usage();
             exit(1);
         }
-        /* Non-option argument is the filename */
+        /* Non-option arguments are filenames */
         if (filename == NULL) {
             filename = argv[i];
+            first_extra = i + 1;
         } else {
-            fprintf(stderr, "Error: Too many arguments\n");
-            print_usage();
-            exit(1);
+            extra++;
         }
     }
 
-    if (filename == NULL) {
+    if (filename == NULL && session == NULL) {
         print_usage();
         exit(1);
     }
 
     /* Initialize editor core */
     init_editor(&E);
-    syntax_select_for_filename(&E, filename);
+    if (filename) syntax_select_for_filename(&E, filename);
+    startup_mark("editor");
 
 #ifdef LOKI_USE_LINENOISE
-    /* Initialize tree-sitter for this file type */
+    /* Initialize tree-sitter for this file type (its query is compiled
+     * by the first highlighting) */
     {
-        const char *ts_lang = treesitter_lang_from_filename(filename);
+        const char *ts_lang = filename ? treesitter_lang_from_filename(filename) : NULL;
         if (ts_lang) {
             E.model.ts_state = treesitter_init(ts_lang);
         }
     }
+    startup_mark("tree-sitter");
 #endif
 
-    editor_open(&E, (char*)filename);
+    int opened = -1;
+    if (filename == NULL) {
+        /* Only a session: an empty buffer, which it replaces */
+        editor_insert_row(&E, 0, "", 0);
+        E.model.dirty = 0;
+    } else if (view) {
+        opened = editor_open_view(&E, (char*)filename);
+    } else {
+        opened = editor_open(&E, (char*)filename);
+    }
+    startup_mark("open file");
 
     /* Initialize LuaHost */
     LuaHost *lua_host = lua_host_create();
@@ -360,18 +656,26 @@ int loki_editor_main(int argc, char **argv) {
 
         /* Initialize REPL */
         lua_host_init_repl(lua_host);
+
+        /* loki.highlight_rows / loki.highlight_row extend the syntax rules */
+        syntax_set_row_hook(lua_highlight_rows);
+        /* loki.declare_language() loads languages as their files open */
+        syntax_set_miss_hook(lua_declared_language_load);
     }
 
+    startup_mark("lua host");
+
     /* Re-select syntax now that Lua has registered dynamic languages */
     if (!E.view.syntax && E.model.filename) {
         syntax_select_for_filename(&E, E.model.filename);
-        /* If syntax was found, refresh highlighting for all rows */
+        /* If syntax was found, re-highlight rows as they are drawn */
         if (E.view.syntax) {
             for (int i = 0; i < E.model.numrows; i++) {
-                syntax_update_row(&E, &E.model.row[i]);
+                syntax_invalidate_row(&E, &E.model.row[i]);
             }
         }
     }
+    startup_mark("syntax");
 
     /* Initialize buffer management with the initial editor context */
     if (buffers_init(&E) != 0) {
@@ -382,69 +686,201 @@ int loki_editor_main(int argc, char **argv) {
     /* Update atexit context to point to buffer manager's context (not local E) */
     editor_set_atexit_context(buffer_get_current());
 
-    /* Auto-initialize language for known file types (must be after buffers_init) */
+    /* The file was read before init.lua could ask for its autocommands */
+    if (opened == 0) autocmd_file_read(buffer_get_current());
+
+    if (follow && filename) follow_start(buffer_get_current(), 0);
+
+    /* The other files, which are read while the first one is shown */
+    if (extra > 0) {
+        for (int i = first_extra; i < argc; i++) {
+            if (strcmp(argv[i], "--record-keys") == 0) i++;  /* Its file */
+            else if (argv[i][0] != '-' && buffer_create(argv[i]) < 0) missing++;
+        }
+        buffers_prefetch();
+    }
+
+    /* The session's buffers after them; it shows its own buffer unless a
+     * file was named */
+    if (session) {
+        int first = buffer_get_current_id();
+        if (access(session, F_OK) == 0 && session_file_load(session, &gone) < 0) {
+            fprintf(stderr, "Error: Can't read session %s\n", session);
+            exit(1);
+        }
+        if (filename) buffer_switch(first);
+        session_file_set_auto(session);
+        editor_set_atexit_context(buffer_get_current());
+    }
+
+    startup_mark("buffers");
+
+    /* The language of the file, if it has one (must be after buffers_init).
+     * Languages that can tell whether they are initialized are left to
+     * their first eval; the rest are initialized now. */
     {
         editor_ctx_t *ctx = buffer_get_current();
-        if (ctx) {
-            /* Create editor-owned SharedContext for all languages to share.
-             * This centralizes audio/MIDI/Link state so switching between
-             * language buffers doesn't cause conflicts. */
-            if (!ctx->model.shared) {
-                ctx->model.shared = (SharedContext *)malloc(sizeof(SharedContext));
-                if (ctx->model.shared) {
-                    if (shared_context_init(ctx->model.shared) != 0) {
-                        fprintf(stderr, "Warning: Failed to initialize shared context\n");
-                        free(ctx->model.shared);
-                        ctx->model.shared = NULL;
-                    }
-                } else {
-                    fprintf(stderr, "Warning: Failed to allocate shared context\n");
-                }
-            }
-
-            int ret = loki_lang_init_for_file(ctx);
+        const LokiLangOps *lang = ctx ? loki_lang_for_buffer(ctx) : NULL;
+        if (lang) {
+            int ret = lang->is_initialized ? 0 : loki_lang_init_for_file(ctx);
             if (ret == 0) {
-                const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
-                if (lang) {
-                    editor_set_status_msg(ctx, "%s mode", lang->name);
-                }
-            } else if (ret == -1) {
+                editor_set_status_msg(ctx, "%s mode", lang->name);
+            } else {
                 const char *err = loki_lang_get_error(ctx);
                 editor_set_status_msg(ctx, "Language init failed: %s", err ? err : "unknown error");
             }
-            /* ret == 1 means no language for this file type, which is fine */
         }
     }
+    startup_mark("language");
+
+    if (startup_time) {
+        /* The first frame, drawn offscreen */
+        editor_ctx_t *ctx = buffer_get_current();
+        Renderer *capture = capture_renderer_create();
+        if (capture) {
+            editor_ctx_set_renderer(ctx, capture);
+            editor_refresh_screen(ctx);
+            editor_ctx_set_renderer(ctx, NULL);
+        }
+        startup_mark("first frame");
+        report_startup();
+        exit(0);
+    }
 
     /* Initialize terminal host and enable raw mode */
     terminal_host_init(g_terminal_host, STDIN_FILENO);
     terminal_host_enable_raw_mode(g_terminal_host);
+    /* After terminal_host_init(), as the loop takes over SIGWINCH. On
+     * failure editor_wait_input() polls stdin with a timeout instead. */
+    event_loop_init(STDIN_FILENO);
+    startup_mark("terminal");
+    startup_end();
     editor_set_status_msg(buffer_get_current(),
         "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-T = new buf | Ctrl-X n/p/k = buf nav");
+    if (missing > 0)
+        editor_set_status_msg(buffer_get_current(), "Can't open %d of %d files",
+                              missing, extra + 1);
+    if (gone > 0)
+        editor_set_status_msg(buffer_get_current(), "%d file%s of the session gone",
+                              gone, gone == 1 ? "" : "s");
+
+    FramePacer pacer;
+    frame_pacer_init(&pacer);
 
     while(1) {
         /* Get current buffer context */
-        editor_ctx_t *ctx = buffer_get_current();
-        if (!ctx) {
-            fprintf(stderr, "Error: No active buffer\n");
-            exit(1);
-        }
+        editor_ctx_t *ctx = current_buffer_or_die();
 
+        if (terminal_host_resize_pending(g_terminal_host))
+            frame_pacer_damage(&pacer);
         terminal_handle_resize(ctx);
 
         /* Check live loops for beat boundary triggers (pushes events to queue) */
         live_loop_tick();
 
-        /* Dispatch all pending async events (timer, custom, user-defined) */
-        async_queue_dispatch_all(NULL, ctx);
+        /* Timers that came due while not waiting on the loop */
+        timer_service_run();
+
+        /* Rows added to a followed file */
+        int follow_due = follow_tick(ctx, uv_hrtime());
+        /* Or a file changed by another program */
+        int reload_due = reload_tick(ctx, uv_hrtime());
+        /* A diff brought up to date with the edits, the other side in step */
+        diffview_tick(ctx);
+        /* Output of the commands rows are filtered through */
+        int filter_due = filter_tick();
+        /* Output background jobs read since, to the queue (when it is
+         * full, the events waiting keep the loop from sleeping) */
+        job_tick();
+        /* What language servers sent, and the edits and requests due */
+        int lsp_due = lsp_tick(uv_hrtime());
+        /* Edits to the plugins watching them, a batch a frame at most */
+        int changes_due = changes_tick(uv_hrtime());
+        /* Files marked for the symbol index, once they settle */
+        int symbols_due = symbols_tick(uv_hrtime());
+        /* Paths marked for the file finder, likewise */
+        int finder_due = finder_tick(uv_hrtime());
+
+        /* Dispatch pending async events (timer, custom, user-defined),
+         * in slices, until the budget runs out. With keys waiting, the
+         * high lane: background results get a small share until a quiet
+         * moment. */
+        AsyncLaneId lowest = terminal_wait_input(STDIN_FILENO, 0) > 0
+            ? ASYNC_LANE_HIGH : ASYNC_LANE_LOW;
+        if (async_queue_dispatch_lanes(NULL, ctx, EDITOR_DISPATCH_BUDGET_NS, lowest) > 0)
+            frame_pacer_damage(&pacer);
 
         /* Update language slot state */
         if (ctx_L(ctx)) {
             loki_lang_check_callbacks(ctx, ctx_L(ctx));
+#ifdef LOKI_ENABLE_HTTP
+            if (loki_http_pending_count() > 0) loki_http_poll(ctx_L(ctx));
+#endif
+        }
+
+        /* Draw at most once per frame, and only if something changed */
+        ctx = current_buffer_or_die();
+        frame_pacer_note_state(&pacer, editor_screen_stamp(ctx));
+        uint64_t now = uv_hrtime();
+        if (frame_pacer_ready(&pacer, now)) {
+            editor_refresh_screen(ctx);
+            frame_pacer_drawn(&pacer, now, editor_screen_stamp(ctx));
+            /* Highlighting ran out of time: keep going next frame */
+            if (syntax_pending(ctx)) frame_pacer_damage(&pacer);
         }
 
-        editor_refresh_screen(ctx);
-        editor_process_keypress(ctx, STDIN_FILENO);
+        /* No keys waiting: idle tasks get part of the time to the next
+         * frame */
+        if (idle_pending() && lowest == ASYNC_LANE_LOW &&
+            idle_run(idle_budget(frame_pacer_timeout(&pacer, uv_hrtime()))))
+            frame_pacer_damage(&pacer);
+
+        /* Sleep until input, a resize, an async event or the next frame.
+         * Only work that has to be polled keeps a periodic tick. */
+        int timeout = frame_pacer_timeout(&pacer, uv_hrtime());
+        if (editor_needs_tick() &&
+            (timeout < 0 || timeout > EDITOR_IDLE_TICK_MS))
+            timeout = EDITOR_IDLE_TICK_MS;
+        int timer = timer_service_timeout();
+        if (timer >= 0 && (timeout < 0 || timer < timeout)) timeout = timer;
+        int due = recovery_tick(uv_hrtime());
+        if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due;
+        due = preview_tick(uv_hrtime());
+        if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due;
+        if (follow_due >= 0 && (timeout < 0 || follow_due < timeout))
+            timeout = follow_due;
+        if (reload_due >= 0 && (timeout < 0 || reload_due < timeout))
+            timeout = reload_due;
+        if (lsp_due >= 0 && (timeout < 0 || lsp_due < timeout))
+            timeout = lsp_due;
+        if (changes_due >= 0 && (timeout < 0 || changes_due < timeout))
+            timeout = changes_due;
+        if (symbols_due >= 0 && (timeout < 0 || symbols_due < timeout))
+            timeout = symbols_due;
+        if (finder_due >= 0 && (timeout < 0 || finder_due < timeout))
+            timeout = finder_due;
+        if (filter_due == 0) timeout = 0;   /* Output left to put in */
+        if (!async_queue_is_empty(NULL)) timeout = 0;  /* Events left over */
+        if (idle_pending() && lowest == ASYNC_LANE_LOW) timeout = 0;  /* Idle work left */
+
+        /* About to sleep with no keys waiting: the Lua collector's turn,
+         * for no more than half the time until the next frame */
+        if (timeout != 0 && lowest == ASYNC_LANE_LOW) {
+            uint64_t budget = timeout > 0 ? (uint64_t)timeout * 500000 : 0;
+            if (budget > LUA_GC_IDLE_BUDGET_NS) budget = 0;
+            lua_gc_idle(ctx_L(ctx), budget);
+        }
+        if (!editor_wait_input(timeout)) continue;
+
+        /* Handle the whole burst (key repeat, a paste) before drawing,
+         * yielding to the screen once a frame's worth of time has passed. */
+        uint64_t burst = uv_hrtime();
+        do {
+            lua_gc_input(ctx_L(current_buffer_or_die()));
+            editor_process_keypress(current_buffer_or_die(), STDIN_FILENO);
+            frame_pacer_damage(&pacer);
+        } while (frame_pacer_within_frame(burst, uv_hrtime()) &&
+                 terminal_wait_input(STDIN_FILENO, 0) > 0);
     }
 
     return 0;
@@ -460,12 +896,9 @@ void editor_cleanup_resources(editor_ctx_t *ctx) {
     /* Clean up all language subsystems (stops all playback) */
     loki_lang_cleanup_all(ctx);
 
-    /* Clean up editor-owned SharedContext after languages are done */
-    if (ctx->model.shared) {
-        shared_context_cleanup(ctx->model.shared);
-        free(ctx->model.shared);
-        ctx->model.shared = NULL;
-    }
+    /* Clean up the languages' SharedContext after they are done */
+    loki_lang_free_shared();
+    ctx->model.shared = NULL;
 
 #ifdef LOKI_USE_LINENOISE
     /* Clean up tree-sitter state */
@@ -475,7 +908,21 @@ void editor_cleanup_resources(editor_ctx_t *ctx) {
     }
 #endif
 
-    /* Clean up async event queue */
+    /* Stop a running :grep, the background jobs, the language servers,
+     * the symbol index and file finder (writing them out), the Lua workers
+     * and the task pool before the queue their results go to */
+    grep_stop_all();
+    job_stop_all();
+    lsp_stop_all();
+    symbols_close();
+    finder_close();
+    lua_worker_stop_all();
+    task_pool_shutdown();
+
+    /* Clean up the timers and event loop handles, then the async event
+     * queue */
+    timer_service_cleanup();
+    event_loop_cleanup();
     async_queue_cleanup();
 
     /* Clean up LuaHost (includes REPL and Lua state) */
@@ -483,4 +930,7 @@ void editor_cleanup_resources(editor_ctx_t *ctx) {
         lua_host_free(ctx->lua_host);
         ctx->lua_host = NULL;
     }
+
+    /* Unmap the spell checker's word list */
+    spell_cleanup();
 }
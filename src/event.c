@@ -9,16 +9,48 @@
 #include "event.h"
 #include "internal.h"
 #include "terminal.h"
+#include "trace.h"
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* ======================= Keycode Conversion =============================== */
 
+/* The event of SGR mouse report 'button' at x, y (see TermMouse), or
+ * EVENT_NONE for one not handled (horizontal wheel, motion with no button) */
+static EditorEvent mouse_report_event(int button, int x, int y, int release) {
+    EditorMouseKind kind = release ? MOUSE_RELEASE : MOUSE_PRESS;
+    int wheel = 0;
+    if (button & 64) {
+        if ((button & 3) > 1) return (EditorEvent){0};
+        kind = MOUSE_WHEEL;
+        wheel = button & 1 ? 1 : -1;
+    } else if (button & 32) {
+        if ((button & 3) == 3) return (EditorEvent){0};
+        kind = MOUSE_DRAG;
+    }
+    EditorEvent ev = event_mouse(kind, kind == MOUSE_WHEEL ? 0 : button & 3, x, y, wheel);
+    ev.data.mouse.modifiers = (button & 4 ? MOD_SHIFT : 0) | (button & 8 ? MOD_ALT : 0) |
+                              (button & 16 ? MOD_CTRL : 0);
+    return ev;
+}
+
 /**
  * Decompose a legacy keycode into base keycode and modifiers.
  * Handles shift-modified keycodes (SHIFT_ARROW_UP -> ARROW_UP + MOD_SHIFT).
  */
 EditorEvent event_from_keycode(int keycode) {
+    if (keycode == PASTE_KEY) {
+        size_t len;
+        const char *text = terminal_paste(&len);
+        return event_paste(text, len);
+    }
+    if (keycode == MOUSE_KEY) {
+        const TermMouse *m = terminal_mouse();
+        return mouse_report_event(m->button, m->x, m->y, m->release);
+    }
+
     EditorEvent ev = {0};
     ev.type = EVENT_KEY;
     ev.data.key.modifiers = MOD_NONE;
@@ -170,12 +202,93 @@ EditorEvent event_resize(int rows, int cols) {
     return ev;
 }
 
+EditorEvent event_paste(const char *text, size_t len) {
+    EditorEvent ev = {0};
+    ev.type = EVENT_PASTE;
+    ev.data.paste.text = text;
+    ev.data.paste.len = len;
+    return ev;
+}
+
+EditorEvent event_mouse(EditorMouseKind kind, int button, int x, int y, int wheel) {
+    EditorEvent ev = {0};
+    ev.type = EVENT_MOUSE;
+    ev.data.mouse.kind = (uint8_t)kind;
+    ev.data.mouse.button = button;
+    ev.data.mouse.pressed = kind != MOUSE_RELEASE;
+    ev.data.mouse.x = x;
+    ev.data.mouse.y = y;
+    ev.data.mouse.wheel = wheel;
+    return ev;
+}
+
 EditorEvent event_quit(void) {
     EditorEvent ev = {0};
     ev.type = EVENT_QUIT;
     return ev;
 }
 
+/* ======================= Terminal Reading ================================= */
+
+/* Keys whose presses in a row are folded into one event */
+static int key_repeats(int keycode) {
+    switch (keycode) {
+        case 'h': case 'j': case 'k': case 'l':
+        case ARROW_LEFT: case ARROW_RIGHT: case ARROW_UP: case ARROW_DOWN:
+        case PAGE_UP: case PAGE_DOWN:
+            return 1;
+    }
+    return 0;
+}
+
+/* Fold the wheel turns (or drags with the same button) waiting behind 'ev'
+ * into it: the notches summed, the cell the last one's */
+static void fold_mouse(int fd, EditorEvent *ev) {
+    for (int n = 1; n < EVENT_REPEAT_MAX && terminal_wait_input(fd, 0) > 0; n++) {
+        int next = terminal_read_key(fd);
+        EditorEvent m = event_from_keycode(next);
+        if (m.type != EVENT_MOUSE || m.data.mouse.kind != ev->data.mouse.kind ||
+            m.data.mouse.button != ev->data.mouse.button ||
+            m.data.mouse.modifiers != ev->data.mouse.modifiers) {
+            /* A MOUSE_KEY given back is still the report in terminal_mouse() */
+            terminal_unread_key(fd, next);
+            return;
+        }
+        ev->data.mouse.wheel += m.data.mouse.wheel;
+        ev->data.mouse.x = m.data.mouse.x;
+        ev->data.mouse.y = m.data.mouse.y;
+    }
+}
+
+EditorEvent event_read_terminal(int fd) {
+    int keycode = terminal_read_key(fd);
+    uint64_t read_ns = trace_begin();
+    EditorEvent ev = event_from_keycode(keycode);
+    if (ev.type == EVENT_MOUSE && (ev.data.mouse.kind == MOUSE_WHEEL ||
+                                   ev.data.mouse.kind == MOUSE_DRAG)) {
+        fold_mouse(fd, &ev);
+        trace_input(&ev, read_ns);
+        return ev;
+    }
+    if (!key_repeats(keycode)) {
+        trace_input(&ev, read_ns);
+        return ev;
+    }
+
+    int repeat = 1;
+    while (repeat < EVENT_REPEAT_MAX && terminal_wait_input(fd, 0) > 0) {
+        int next = terminal_read_key(fd);
+        if (next != keycode) {
+            terminal_unread_key(fd, next);
+            break;
+        }
+        repeat++;
+    }
+    ev.data.key.repeat = repeat;
+    trace_input(&ev, read_ns);
+    return ev;
+}
+
 /* ======================= Terminal Event Source ============================ */
 
 typedef struct {
@@ -186,8 +299,7 @@ static EditorEvent terminal_source_read(EventSource *src, int timeout_ms) {
     TerminalSourceData *data = (TerminalSourceData *)src->data;
     (void)timeout_ms;  /* terminal_read_key has its own timeout */
 
-    int keycode = terminal_read_key(data->fd);
-    return event_from_keycode(keycode);
+    return event_read_terminal(data->fd);
 }
 
 static int terminal_source_poll(EventSource *src) {
@@ -301,3 +413,148 @@ int event_source_test_push_key(EventSource *src, int keycode) {
     EditorEvent ev = event_from_keycode(keycode);
     return event_source_test_push(src, &ev);
 }
+
+/* ======================= Replay Event Source ============================== */
+
+typedef struct {
+    EditorEvent *events;
+    int count;
+    int next;
+    char *trace;        /* The trace read, which pastes point into */
+} ReplaySourceData;
+
+static EditorEvent replay_source_read(EventSource *src, int timeout_ms) {
+    ReplaySourceData *data = (ReplaySourceData *)src->data;
+    (void)timeout_ms;
+
+    if (data->next >= data->count) {
+        EditorEvent ev = {0};
+        ev.type = EVENT_NONE;
+        return ev;
+    }
+    return data->events[data->next++];
+}
+
+static int replay_source_poll(EventSource *src) {
+    ReplaySourceData *data = (ReplaySourceData *)src->data;
+    return data->next < data->count;
+}
+
+static void replay_source_destroy(EventSource *src) {
+    if (src) {
+        ReplaySourceData *data = (ReplaySourceData *)src->data;
+        free(data->events);
+        free(data->trace);
+        free(data);
+        free(src);
+    }
+}
+
+/* Read all of 'path' into a NUL-terminated buffer, its length in *len */
+static char *read_trace(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    char *buf = NULL;
+    size_t cap = 0, n;
+    *len = 0;
+    do {
+        if (*len + 4096 + 1 > cap) {
+            cap = cap ? cap * 2 : 8192;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                fclose(fp);
+                return NULL;
+            }
+            buf = grown;
+        }
+        n = fread(buf + *len, 1, 4096, fp);
+        *len += n;
+    } while (n > 0);
+    int failed = ferror(fp);
+    fclose(fp);
+    if (failed) {
+        free(buf);
+        errno = EIO;
+        return NULL;
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+/* Parse the trace of 'data' into its events. Returns 0, or -1 if it is
+ * not a key trace. */
+static int parse_trace(ReplaySourceData *data, size_t len) {
+    char *p = data->trace, *end = data->trace + len;
+    int cap = 0;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+
+        EditorEvent ev;
+        char *after;
+        if (p == eol || *p == '#') {
+            p = eol + 1;
+            continue;
+        } else if (strncmp(p, "paste ", 6) == 0) {
+            unsigned long n = strtoul(p + 6, &after, 10);
+            if (after != eol || eol == end || n > (size_t)(end - eol - 1)) return -1;
+            ev = event_paste(eol + 1, n);
+            eol += 1 + n;
+        } else if (strncmp(p, "mouse ", 6) == 0) {
+            long v[3];
+            char *q = p + 5;
+            for (int i = 0; i < 3; i++) {
+                if (*q != ' ') return -1;
+                v[i] = strtol(q + 1, &after, 10);
+                if (after == q + 1) return -1;
+                q = after;
+            }
+            int release = eol - q == 2 && memcmp(q, " m", 2) == 0;
+            if (q + 2 * release != eol) return -1;
+            ev = mouse_report_event((int)v[0], (int)v[1], (int)v[2], release);
+            if (ev.type == EVENT_NONE) {
+                p = eol + 1;
+                continue;
+            }
+        } else {
+            long key = strtol(p, &after, 10);
+            if (after == p || after != eol || key == PASTE_KEY || key == MOUSE_KEY) return -1;
+            ev = event_from_keycode((int)key);
+        }
+
+        if (data->count == cap) {
+            cap = cap ? cap * 2 : 256;
+            EditorEvent *grown = realloc(data->events, (size_t)cap * sizeof(*grown));
+            if (!grown) return -1;
+            data->events = grown;
+        }
+        data->events[data->count++] = ev;
+        p = eol + 1;
+    }
+    return 0;
+}
+
+EventSource *event_source_replay(const char *path) {
+    EventSource *src = calloc(1, sizeof(EventSource));
+    ReplaySourceData *data = calloc(1, sizeof(ReplaySourceData));
+    size_t len;
+    if (!src || !data || !(data->trace = read_trace(path, &len))) {
+        free(data);
+        free(src);
+        return NULL;
+    }
+
+    src->data = data;
+    src->read = replay_source_read;
+    src->poll = replay_source_poll;
+    src->destroy = replay_source_destroy;
+    if (parse_trace(data, len) != 0) {
+        replay_source_destroy(src);
+        errno = EINVAL;
+        return NULL;
+    }
+    return src;
+}
@@ -26,8 +26,9 @@ typedef enum {
     EVENT_COMMAND,    /* Ex-command string (e.g., ":w", ":q") */
     EVENT_ACTION,     /* Named action (e.g., "save", "quit") */
     EVENT_RESIZE,     /* Terminal resize */
-    EVENT_MOUSE,      /* Mouse input (future) */
+    EVENT_MOUSE,      /* Mouse press, release, drag or wheel */
     EVENT_QUIT,       /* Quit request */
+    EVENT_PASTE,      /* Pasted text, put in as one edit */
 } EditorEventType;
 
 /* ======================= Modifier Flags =================================== */
@@ -39,6 +40,15 @@ typedef enum {
     MOD_ALT   = (1 << 2),
 } EditorModifier;
 
+/* ======================= Mouse Event Kinds ================================ */
+
+typedef enum {
+    MOUSE_PRESS = 0,
+    MOUSE_RELEASE,
+    MOUSE_DRAG,       /* Moved with a button held */
+    MOUSE_WHEEL,      /* Wheel turned, by 'wheel' notches */
+} EditorMouseKind;
+
 /* ======================= EditorEvent Structure ============================ */
 
 /**
@@ -62,6 +72,8 @@ typedef struct {
             uint8_t modifiers;     /* EditorModifier flags */
             char utf8[5];          /* UTF-8 representation (null-terminated) */
             uint8_t utf8_len;      /* Length of UTF-8 sequence */
+            int repeat;            /* Presses in a row folded into this one
+                                    * (0 counts as 1), see event_read_terminal() */
         } key;
 
         /* EVENT_COMMAND: Ex-command string */
@@ -81,13 +93,23 @@ typedef struct {
             int cols;
         } resize;
 
-        /* EVENT_MOUSE: Mouse input (future) */
+        /* EVENT_MOUSE: Mouse input */
         struct {
-            int x, y;              /* Click position */
+            int x, y;              /* Cell, 1-based (the last one, for
+                                    * motions folded together) */
             int button;            /* Mouse button (0=left, 1=middle, 2=right) */
-            int pressed;           /* 1=pressed, 0=released */
+            int pressed;           /* 1=pressed (or held), 0=released */
             uint8_t modifiers;     /* EditorModifier flags */
+            uint8_t kind;          /* EditorMouseKind */
+            int wheel;             /* MOUSE_WHEEL: notches, > 0 down, < 0 up,
+                                    * summed over the turns folded in */
         } mouse;
+
+        /* EVENT_PASTE: Pasted text */
+        struct {
+            const char *text;      /* Not NUL-terminated; line breaks as LF */
+            size_t len;
+        } paste;
     } data;
 } EditorEvent;
 
@@ -169,13 +191,42 @@ int event_source_test_push(EventSource *src, const EditorEvent *ev);
  */
 int event_source_test_push_key(EventSource *src, int keycode);
 
+/**
+ * Read a key from the terminal as an event, folding the presses of the same
+ * motion key (h/j/k/l, arrows, Page Up/Down) already waiting behind it into
+ * its repeat count, up to EVENT_REPEAT_MAX. A held key comes faster than
+ * frames are drawn; this way a burst of it is one event, applied as one
+ * motion. Wheel turns waiting are summed into one MOUSE_WHEEL the same way,
+ * and drags with the same button into one at the last cell, so a trackpad
+ * scroll is a frame per burst, not per report. Never waits for more presses
+ * than have come.
+ * @param fd  Terminal file descriptor
+ * @return EditorEvent, as event_from_keycode(terminal_read_key(fd)) would
+ */
+EditorEvent event_read_terminal(int fd);
+
+/* Most presses folded into one event */
+#define EVENT_REPEAT_MAX 1000
+
+/**
+ * Create a replay event source.
+ * Replays the key trace at 'path', as recorded by terminal_record_keys()
+ * (--record-keys), an event per key, as fast as it is read; EVENT_NONE
+ * once all are.
+ * @param path  Key trace file
+ * @return Event source, or NULL with errno set (EINVAL: not a key trace)
+ */
+EventSource *event_source_replay(const char *path);
+
 /* ======================= Conversion Functions ============================= */
 
 /**
  * Convert legacy keycode to EditorEvent.
  * Decomposes modifier-encoded keycodes (e.g., SHIFT_ARROW_UP -> ARROW_UP + MOD_SHIFT).
+ * PASTE_KEY becomes the EVENT_PASTE of the text in terminal_paste(), and
+ * MOUSE_KEY the EVENT_MOUSE of the report in terminal_mouse().
  * @param keycode  Legacy keycode from terminal_read_key()
- * @return EditorEvent with type EVENT_KEY
+ * @return EditorEvent with type EVENT_KEY (or EVENT_PASTE, EVENT_MOUSE)
  */
 EditorEvent event_from_keycode(int keycode);
 
@@ -209,6 +260,17 @@ EditorEvent event_action(const char *action, const char *args);
  */
 EditorEvent event_resize(int rows, int cols);
 
+/**
+ * Create a paste event. 'text' is not copied.
+ */
+EditorEvent event_paste(const char *text, size_t len);
+
+/**
+ * Create a mouse event at 1-based cell x, y. 'wheel' is the notches of a
+ * MOUSE_WHEEL (> 0 down), 0 for the other kinds.
+ */
+EditorEvent event_mouse(EditorMouseKind kind, int button, int x, int y, int wheel);
+
 /**
  * Create a quit event.
  */
@@ -237,6 +299,13 @@ static inline int event_has_alt(const EditorEvent *ev) {
     return ev->type == EVENT_KEY && (ev->data.key.modifiers & MOD_ALT);
 }
 
+/**
+ * Times a key event was pressed in a row (1 for a single press).
+ */
+static inline int event_repeat(const EditorEvent *ev) {
+    return ev->type == EVENT_KEY && ev->data.key.repeat > 1 ? ev->data.key.repeat : 1;
+}
+
 /**
  * Check if event is a printable character (ASCII 32-126).
  */
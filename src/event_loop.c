@@ -0,0 +1,128 @@
+/* event_loop.c - Main-thread wait on the libuv loop
+ *
+ * See event_loop.h for an overview. All state is main-thread only.
+ */
+
+#include "event_loop.h"
+#include "terminal.h"
+#include "async_queue.h"
+#include <poll.h>
+#include <signal.h>
+#include <uv.h>
+
+static struct {
+    int active;
+    int fd;
+    int fd_watched;           /* 'input' runs; else poll() fd and backend */
+    int fired;                /* EVENT_LOOP_* bits set by the callbacks */
+    uv_loop_t *loop;
+    uv_poll_t input;
+    uv_signal_t winch;
+    uv_timer_t deadline;
+} ev;
+
+static void on_input(uv_poll_t *handle, int status, int events) {
+    (void)handle;
+    (void)events;
+    /* On error let the reader run too; it reports the failure */
+    (void)status;
+    ev.fired |= EVENT_LOOP_INPUT;
+}
+
+static void on_winch(uv_signal_t *handle, int signum) {
+    (void)handle;
+    terminal_sig_winch_handler(signum);
+    ev.fired |= EVENT_LOOP_RESIZE;
+}
+
+static void on_deadline(uv_timer_t *handle) {
+    (void)handle;
+    ev.fired |= EVENT_LOOP_TIMEOUT;
+}
+
+int event_loop_init(int input_fd) {
+    if (ev.active) return 0;
+
+    ev.loop = uv_default_loop();
+    if (!ev.loop) return -1;
+    ev.fd = input_fd;
+    ev.fired = 0;
+
+    if (uv_timer_init(ev.loop, &ev.deadline) != 0) return -1;
+    if (uv_signal_init(ev.loop, &ev.winch) != 0 ||
+        uv_signal_start(&ev.winch, on_winch, SIGWINCH) != 0) {
+        uv_close((uv_handle_t *)&ev.deadline, NULL);
+        uv_run(ev.loop, UV_RUN_NOWAIT);
+        return -1;
+    }
+
+    /* Not every backend can watch every fd: fall back to poll() then */
+    ev.fd_watched = uv_poll_init(ev.loop, &ev.input, input_fd) == 0;
+    if (ev.fd_watched &&
+        uv_poll_start(&ev.input, UV_READABLE, on_input) != 0) {
+        uv_close((uv_handle_t *)&ev.input, NULL);
+        ev.fd_watched = 0;
+    }
+
+    ev.active = 1;
+    return 0;
+}
+
+void event_loop_cleanup(void) {
+    if (!ev.active) return;
+
+    if (ev.fd_watched) uv_close((uv_handle_t *)&ev.input, NULL);
+    uv_close((uv_handle_t *)&ev.winch, NULL);
+    uv_close((uv_handle_t *)&ev.deadline, NULL);
+    uv_run(ev.loop, UV_RUN_NOWAIT);  /* Run the close callbacks */
+    ev.active = 0;
+
+    /* libuv resets SIGWINCH to the default; resizes go to the flag again */
+    signal(SIGWINCH, terminal_sig_winch_handler);
+}
+
+int event_loop_active(void) {
+    return ev.active;
+}
+
+/* Wait on stdin and the loop's backend fd at once. */
+static void wait_unwatched(void) {
+    uv_run(ev.loop, UV_RUN_NOWAIT);
+    if (ev.fired) return;
+
+    struct pollfd pfd[2] = {
+        { .fd = ev.fd, .events = POLLIN, .revents = 0 },
+        { .fd = uv_backend_fd(ev.loop), .events = POLLIN, .revents = 0 }
+    };
+    int n = poll(pfd, pfd[1].fd >= 0 ? 2 : 1, uv_backend_timeout(ev.loop));
+    if (n > 0 && pfd[0].revents) ev.fired |= EVENT_LOOP_INPUT;
+    uv_run(ev.loop, UV_RUN_NOWAIT);
+}
+
+int event_loop_wait(int timeout_ms) {
+    if (!ev.active) return 0;
+
+    ev.fired = 0;
+    /* Keys already read ahead are input that a poll of the fd would miss */
+    if (terminal_input_pending(ev.fd)) {
+        ev.fired |= EVENT_LOOP_INPUT;
+        timeout_ms = 0;
+    }
+    if (timeout_ms > 0)
+        uv_timer_start(&ev.deadline, on_deadline, (uint64_t)timeout_ms, 0);
+
+    if (timeout_ms == 0) {
+        uv_run(ev.loop, UV_RUN_NOWAIT);
+        if (!ev.fd_watched && terminal_wait_input(ev.fd, 0) > 0)
+            ev.fired |= EVENT_LOOP_INPUT;
+        ev.fired |= EVENT_LOOP_TIMEOUT;
+    } else if (ev.fd_watched) {
+        uv_run(ev.loop, UV_RUN_ONCE);
+    } else {
+        wait_unwatched();
+    }
+
+    uv_timer_stop(&ev.deadline);
+    if (!async_queue_is_empty(NULL)) ev.fired |= EVENT_LOOP_ASYNC;
+    return ev.fired;
+}
@@ -0,0 +1,44 @@
+/* event_loop.h - Main-thread wait on the libuv loop
+ *
+ * The interactive loops sleep in event_loop_wait() instead of polling
+ * stdin with a timeout. Everything that can wake the editor is a handle
+ * on uv_default_loop(), the loop the async event queue already uses:
+ *
+ *   - stdin readability (uv_poll_t; the bytes are still read with
+ *     terminal_read_key())
+ *   - SIGWINCH (uv_signal_t, which feeds terminal_sig_winch_handler())
+ *   - the async queue's uv_async_t, so an event pushed by a worker thread
+ *     wakes the wait at once
+ *   - a uv_timer_t for the caller's deadline (the next frame)
+ *
+ * With nothing pending a wait with no deadline blocks in the kernel and
+ * costs no CPU. Some backends cannot watch a terminal (kqueue on macOS
+ * refuses ttys); then the wait polls stdin and the loop's backend fd
+ * together, which wakes on the same events.
+ */
+
+#ifndef LOKI_EVENT_LOOP_H
+#define LOKI_EVENT_LOOP_H
+
+/* What ended an event_loop_wait() (bit set) */
+#define EVENT_LOOP_INPUT   1    /* Input is readable */
+#define EVENT_LOOP_RESIZE  2    /* The window size changed */
+#define EVENT_LOOP_ASYNC   4    /* Async queue events are pending */
+#define EVENT_LOOP_TIMEOUT 8    /* The deadline passed */
+
+/* Attach the loop to 'input_fd' and SIGWINCH. Returns 0 on success, -1 if
+ * libuv could not set up the handles (callers fall back to
+ * terminal_wait_input()). */
+int event_loop_init(int input_fd);
+
+/* Close the handles and restore the default SIGWINCH handling. */
+void event_loop_cleanup(void);
+
+/* 1 between a successful event_loop_init() and event_loop_cleanup(). */
+int event_loop_active(void);
+
+/* Run the loop until something happens or 'timeout_ms' passes (-1: no
+ * deadline). Returns EVENT_LOOP_* bits, 0 if another handle ran. */
+int event_loop_wait(int timeout_ms);
+
+#endif /* LOKI_EVENT_LOOP_H */
@@ -0,0 +1,487 @@
+/* filter.c - Filtering rows through an external command (:%!cmd)
+ *
+ * See filter.h for an overview. The rows being filtered always lie at
+ * rows at..at+left-1: output goes in above them at 'at', and the rows the
+ * command has taken go out from their top. The first 'sent' of them have
+ * been handed to uv_write(), the first 'done' of those written.
+ *
+ * A write points into the rows it sends, and editor_replace_range()
+ * rewrites the rows an edit starts and ends on. So every edit starts and
+ * ends at the end of a row above the rows not yet written, which it only
+ * moves: output goes in as "\nline...\nline" after row at-1, and rows
+ * taken go out from the end of row at-1 to the end of the last of them.
+ * A range that starts the buffer gets an empty row above it while it is
+ * filtered, for a row at-1 there is. Output is read in after a newline
+ * kept at the start of the buffer it is read into, so that it goes in
+ * as it is.
+ */
+
+#define _DEFAULT_SOURCE     /* strdup() */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "filter.h"
+#include "undo.h"
+
+/* Bytes of the command's stderr kept for the status */
+#define FILTER_ERR_MAX 160
+
+/* Bytes asked of the loop per read of stdout */
+#define FILTER_READ_CHUNK ((size_t)64 << 10)
+
+struct FilterJob {
+    editor_ctx_t *ctx;      /* NULL once stopped */
+    FilterJob *next;        /* Running filters */
+    char *cmd;
+    uv_process_t proc;      /* The handles' data is the FilterJob */
+    uv_pipe_t in, out, err;
+    int open;               /* Handles not closed yet */
+    int exited;
+    int64_t status;
+    int term_signal;
+
+    int at;                 /* Row the next line of output goes to */
+    int left;               /* Rows being filtered still in the buffer */
+    int sent;               /* ... of them handed to uv_write() */
+    int done;               /* ... of those written */
+    size_t ahead;           /* Bytes handed to uv_write() and not written */
+    int input_end;          /* The command stopped reading: drop the rest */
+    int first;              /* Row the range started on */
+    int sentinel;           /* An empty row was added above the range */
+    int edits;              /* Edits made, all in one undo group */
+    int rows_in, rows_out;  /* Rows taken, and put in */
+    int shown_in, shown_out;    /* ... as last said in the status */
+
+    char *out_buf;          /* A newline, then output read and not yet put in */
+    size_t out_len, out_cap;    /* ... of the output */
+    int out_lines;          /* Newlines in out_buf */
+    int out_eof;
+    int paused;             /* Reading stopped: out_buf is full */
+    char err_buf[FILTER_ERR_MAX];
+    size_t err_len;
+    char err_scratch[256];
+    int err_eof;
+};
+
+typedef struct FilterWrite {
+    uv_write_t req;         /* Its data is the FilterWrite */
+    FilterJob *job;
+    int rows;
+    size_t bytes;
+} FilterWrite;
+
+static FilterJob *running;
+
+static void job_free(FilterJob *job) {
+    free(job->cmd);
+    free(job->out_buf);
+    free(job);
+}
+
+static void on_close(uv_handle_t *handle) {
+    FilterJob *job = handle->data;
+    if (--job->open == 0 && job->ctx == NULL) job_free(job);
+}
+
+static void close_handle(FilterJob *job, uv_handle_t *handle) {
+    (void)job;
+    if (!uv_is_closing(handle)) uv_close(handle, on_close);
+}
+
+/* The range's rows left at 'at' that the command will not read: it
+ * stopped, or all of them have been written */
+static int input_over(const FilterJob *job) {
+    return job->input_end || (job->sent == job->left && job->ahead == 0);
+}
+
+/* ============================ The command =============================== */
+
+static void send_more(FilterJob *job);
+
+static void on_write(uv_write_t *req, int status) {
+    FilterWrite *w = req->data;
+    FilterJob *job = w->job;
+    job->ahead -= w->bytes;
+    if (status < 0) job->input_end = 1;     /* EPIPE: it quit reading */
+    else job->done += w->rows;
+    free(w);
+    if (job->ctx) send_more(job);
+}
+
+/* Write rows to the command's stdin until FILTER_WRITE_AHEAD bytes are in
+ * flight, and close it once all are written */
+static void send_more(FilterJob *job) {
+    if (job->input_end || uv_is_closing((uv_handle_t *)&job->in))
+        return;
+    const t_erow *rows = job->ctx->model.row + job->at;
+    while (job->sent < job->left && job->ahead < FILTER_WRITE_AHEAD) {
+        uv_buf_t bufs[FILTER_WRITE_ROWS * 2];
+        int n = 0, count = 0;
+        size_t bytes = 0;
+        while (count < FILTER_WRITE_ROWS && job->sent + count < job->left &&
+               job->ahead + bytes < FILTER_WRITE_AHEAD) {
+            const t_erow *row = &rows[job->sent + count];
+            if (row->size > 0)
+                bufs[n++] = uv_buf_init(row->chars, (unsigned int)row->size);
+            bufs[n++] = uv_buf_init((char *)"\n", 1);
+            bytes += (size_t)row->size + 1;
+            count++;
+        }
+        FilterWrite *w = malloc(sizeof(FilterWrite));
+        if (w == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        w->req.data = w;
+        w->job = job;
+        w->rows = count;
+        w->bytes = bytes;
+        if (uv_write(&w->req, (uv_stream_t *)&job->in, bufs, (unsigned int)n,
+                     on_write) != 0) {
+            free(w);
+            job->input_end = 1;
+            break;
+        }
+        job->sent += count;
+        job->ahead += bytes;
+    }
+    /* All written, or no use writing more: end of its input */
+    if (input_over(job)) close_handle(job, (uv_handle_t *)&job->in);
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    (void)suggested;
+    FilterJob *job = handle->data;
+    /* Room for a chunk, and the newline a last line may lack */
+    if (job->out_cap - job->out_len < FILTER_READ_CHUNK + 1) {
+        size_t cap = job->out_cap ? job->out_cap * 2 : FILTER_READ_CHUNK * 2;
+        while (cap - job->out_len < FILTER_READ_CHUNK + 1) cap *= 2;
+        char *out = realloc(job->out_buf, cap + 1);
+        if (out == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        out[0] = '\n';
+        job->out_buf = out;
+        job->out_cap = cap;
+    }
+    *buf = uv_buf_init(job->out_buf + 1 + job->out_len, (unsigned int)FILTER_READ_CHUNK);
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    FilterJob *job = stream->data;
+    if (nread > 0) {
+        for (const char *p = buf->base; (p = memchr(p, '\n', (size_t)(buf->base + nread - p)));
+             p++)
+            job->out_lines++;
+        job->out_len += (size_t)nread;
+        if (job->out_len >= FILTER_OUT_MAX) {
+            uv_read_stop(stream);
+            job->paused = 1;
+        }
+        return;
+    }
+    if (nread == 0) return;
+
+    /* EOF (or an error, taken as one): the last line may lack its newline */
+    job->out_eof = 1;
+    if (job->out_len > 0 && job->out_buf[job->out_len] != '\n') {
+        job->out_buf[1 + job->out_len++] = '\n';     /* on_alloc() left room */
+        job->out_lines++;
+    }
+    close_handle(job, (uv_handle_t *)stream);
+}
+
+static void on_err_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    (void)suggested;
+    FilterJob *job = handle->data;
+    *buf = uv_buf_init(job->err_scratch, sizeof(job->err_scratch));
+}
+
+static void on_err_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    FilterJob *job = stream->data;
+    if (nread > 0) {
+        size_t room = sizeof(job->err_buf) - 1 - job->err_len;
+        size_t n = (size_t)nread < room ? (size_t)nread : room;
+        memcpy(job->err_buf + job->err_len, buf->base, n);
+        job->err_len += n;
+        job->err_buf[job->err_len] = '\0';
+    } else if (nread < 0) {
+        job->err_eof = 1;
+        close_handle(job, (uv_handle_t *)stream);
+    }
+}
+
+static void on_proc_exit(uv_process_t *proc, int64_t status, int term_signal) {
+    FilterJob *job = proc->data;
+    job->exited = 1;
+    job->status = status;
+    job->term_signal = term_signal;
+    close_handle(job, (uv_handle_t *)proc);
+}
+
+/* Take the job off its buffer and out of the running list, and let the
+ * command go: its input ends, its output is no longer read, and it is
+ * killed if it has not exited. The job is freed once its handles close. */
+static void detach(FilterJob *job) {
+    for (FilterJob **p = &running; *p; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+    job->ctx->model.filter = NULL;
+    job->ctx = NULL;
+    close_handle(job, (uv_handle_t *)&job->in);
+    close_handle(job, (uv_handle_t *)&job->out);
+    close_handle(job, (uv_handle_t *)&job->err);
+    if (!job->exited) uv_process_kill(&job->proc, SIGTERM);
+    if (job->open == 0) job_free(job);
+}
+
+/* ============================== The rows ================================ */
+
+/* Replace a span of the buffer, letting the filter's own edits through
+ * the read-only check */
+static void replace(FilterJob *job, int row, int col, int end_row, int end_col,
+                    const char *text, size_t len) {
+    EditorModel *model = &job->ctx->model;
+    model->filter = NULL;
+    editor_replace_range(job->ctx, row, col, end_row, end_col, text, len, NULL, NULL);
+    model->filter = job;
+    job->edits++;
+}
+
+/* Take the first 'n' rows left out of the buffer */
+static void delete_rows(FilterJob *job, int n) {
+    const t_erow *row = job->ctx->model.row;
+    int above = job->at - 1, end = job->at + n - 1;
+    replace(job, above, row[above].size, end, row[end].size, "", 0);
+    job->left -= n;
+}
+
+/* Put the complete lines read, up to FILTER_APPLY_MAX bytes of them, in
+ * above the rows left */
+static void insert_output(FilterJob *job) {
+    char *out = job->out_buf + 1;
+    size_t len = job->out_len < FILTER_APPLY_MAX ? job->out_len : FILTER_APPLY_MAX;
+    const char *nl = NULL;
+    for (size_t i = len; i > 0 && nl == NULL; i--)
+        if (out[i - 1] == '\n') nl = out + i - 1;
+    if (nl == NULL) nl = memchr(out + len, '\n', job->out_len - len);
+    if (nl == NULL) return;
+
+    size_t n = (size_t)(nl - out) + 1;
+    int lines = 0;
+    for (const char *p = out; (p = memchr(p, '\n', (size_t)(nl + 1 - p))); p++)
+        lines++;
+    /* The newline before them and not the last: whole rows after row
+     * at-1, which keeps its contents */
+    int above = job->at - 1;
+    replace(job, above, job->ctx->model.row[above].size, above,
+            job->ctx->model.row[above].size, job->out_buf, n);
+    job->at += lines;
+    job->rows_out += lines;
+    job->out_lines -= lines;
+    memmove(out, out + n, job->out_len - n);
+    job->out_len -= n;
+
+    if (job->paused && job->out_len < FILTER_OUT_MAX / 2 && !job->out_eof) {
+        job->paused = 0;
+        uv_read_start((uv_stream_t *)&job->out, on_alloc, on_read);
+    }
+}
+
+/* The edits made undone, in one step */
+static void put_back(editor_ctx_t *ctx, int edits) {
+    undo_release_group(ctx);
+    if (edits > 0) undo_perform(ctx);
+}
+
+/* The command is done and its output in: drop the rows it did not read,
+ * and the row added above them */
+static void finish(FilterJob *job) {
+    editor_ctx_t *ctx = job->ctx;
+    char *cmd = job->cmd;
+    job->cmd = NULL;
+    int edits = job->edits;
+
+    if (job->term_signal || job->status != 0) {
+        char err[FILTER_ERR_MAX];
+        snprintf(err, sizeof(err), "%s", job->err_buf);
+        err[strcspn(err, "\r\n")] = '\0';
+        int status = (int)job->status, sig = job->term_signal;
+        detach(job);
+        put_back(ctx, edits);
+        if (sig)
+            editor_set_status_msg(ctx, "%.40s: killed by signal %d, rows put back", cmd, sig);
+        else
+            editor_set_status_msg(ctx, "%.40s: exit %d, rows put back%s%s", cmd, status,
+                                  err[0] ? ": " : "", err);
+        free(cmd);
+        return;
+    }
+
+    job->rows_in += job->done;
+    if (job->left > 0) delete_rows(job, job->left);
+    if (job->sentinel && ctx->model.numrows > 1) replace(job, 0, 0, 1, 0, "", 0);
+    int first = job->first, in = job->rows_in, out = job->rows_out;
+    detach(job);
+    undo_release_group(ctx);
+    if (first >= ctx->model.numrows) first = ctx->model.numrows - 1;
+    editor_cursor_to(ctx, first < 0 ? 0 : first, 0);
+    editor_set_status_msg(ctx, "%d line%s filtered through %.40s, %d back", in,
+                          in == 1 ? "" : "s", cmd, out);
+    free(cmd);
+}
+
+/* Make the edits due, take the job as far as it can go, and finish it if
+ * it is done. Returns 1 if output is left to put in now. */
+static int progress(FilterJob *job) {
+    EditorModel *model = &job->ctx->model;
+    int over = input_over(job);
+    int del = job->done > 0 &&
+              (over || job->done * 4 >= model->numrows - (job->at + job->done));
+    int ins = job->out_lines > 0 &&
+              (job->out_eof || job->paused ||
+               job->out_lines * 4 >= model->numrows - job->at);
+    if (del) {
+        int n = job->done;
+        delete_rows(job, n);
+        job->sent -= n;
+        job->done = 0;
+        job->rows_in += n;
+    }
+    if (ins) insert_output(job);
+
+    if (job->exited && job->out_eof && job->err_eof && job->out_lines == 0 &&
+        input_over(job) && job->ahead == 0) {
+        finish(job);
+        return 0;
+    }
+
+    editor_ctx_t *ctx = job->ctx;
+    int cursor = ctx->view.rowoff + ctx->view.cy;
+    if (cursor >= model->numrows) editor_cursor_to(ctx, model->numrows - 1, 0);
+    if (job->rows_in + job->done != job->shown_in || job->rows_out != job->shown_out) {
+        job->shown_in = job->rows_in + job->done;
+        job->shown_out = job->rows_out;
+        editor_set_status_msg(ctx, "Filtering through %.40s: %d lines in, %d out (:! stops it)",
+                              job->cmd, job->shown_in, job->shown_out);
+    }
+    return ins && job->out_lines > 0;
+}
+
+/* ================================= API ================================== */
+
+int filter_start(editor_ctx_t *ctx, int first, int last, const char *cmd) {
+    static int sigpipe_ignored;
+    if (editor_refuse_edit(ctx)) return -1;
+    EditorModel *model = &ctx->model;
+    if (first < 0) first = 0;
+    if (last >= model->numrows) last = model->numrows - 1;
+    if (first > last) {
+        editor_set_status_msg(ctx, "No lines to filter");
+        return -1;
+    }
+    /* A command that quits reading is an EPIPE from the write, not the
+     * end of the editor */
+    if (!sigpipe_ignored) {
+        signal(SIGPIPE, SIG_IGN);
+        sigpipe_ignored = 1;
+    }
+
+    FilterJob *job = calloc(1, sizeof(FilterJob));
+    char *dup = strdup(cmd);
+    if (job == NULL || dup == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    job->cmd = dup;
+    uv_loop_t *loop = uv_default_loop();
+    uv_pipe_init(loop, &job->in, 0);
+    uv_pipe_init(loop, &job->out, 0);
+    uv_pipe_init(loop, &job->err, 0);
+    job->in.data = job->out.data = job->err.data = job->proc.data = job;
+    job->open = 4;
+
+    char *args[] = { "sh", "-c", job->cmd, NULL };
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+    stdio[0].data.stream = (uv_stream_t *)&job->in;
+    stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[1].data.stream = (uv_stream_t *)&job->out;
+    stdio[2].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[2].data.stream = (uv_stream_t *)&job->err;
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.file = "/bin/sh";
+    options.args = args;
+    options.exit_cb = on_proc_exit;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+    int rc = uv_spawn(loop, &job->proc, &options);
+    if (rc != 0) {
+        editor_set_status_msg(ctx, "Cannot run %.40s: %s", cmd, uv_strerror(rc));
+        close_handle(job, (uv_handle_t *)&job->in);
+        close_handle(job, (uv_handle_t *)&job->out);
+        close_handle(job, (uv_handle_t *)&job->err);
+        close_handle(job, (uv_handle_t *)&job->proc);
+        return -1;
+    }
+    uv_read_start((uv_stream_t *)&job->out, on_alloc, on_read);
+    uv_read_start((uv_stream_t *)&job->err, on_err_alloc, on_err_read);
+
+    job->ctx = ctx;
+    job->next = running;
+    running = job;
+    undo_hold_group(ctx);
+    model->filter = job;
+    job->first = first;
+    job->at = first;
+    job->left = last - first + 1;
+    if (first == 0) {
+        replace(job, 0, 0, 0, 0, "\n", 1);
+        job->sentinel = 1;
+        job->at++;
+    }
+    send_more(job);
+    editor_set_status_msg(ctx, "Filtering %d line%s through %.40s (:! stops it)",
+                          job->left, job->left == 1 ? "" : "s", cmd);
+    return 0;
+}
+
+int filter_cancel(editor_ctx_t *ctx) {
+    FilterJob *job = ctx->model.filter;
+    if (job == NULL) {
+        editor_set_status_msg(ctx, "No filter running");
+        return -1;
+    }
+    int edits = job->edits;
+    detach(job);
+    put_back(ctx, edits);
+    editor_set_status_msg(ctx, "Filter stopped, rows put back");
+    return 0;
+}
+
+void filter_stop(EditorModel *model) {
+    FilterJob *job = model->filter;
+    if (job == NULL) return;
+    editor_ctx_t *ctx = job->ctx;
+    detach(job);
+    undo_release_group(ctx);
+}
+
+int filter_tick(void) {
+    int more = 0;
+    for (FilterJob *job = running, *next; job; job = next) {
+        next = job->next;
+        if (progress(job)) more = 1;
+    }
+    return more ? 0 : -1;
+}
@@ -0,0 +1,65 @@
+/* filter.h - Filtering rows through an external command (:%!cmd)
+ *
+ * filter_start() runs a command with `sh -c` (uv_spawn()) on the loop
+ * event_loop_wait() sleeps in, and replaces rows first..last with what it
+ * writes to its stdout, as vi's :{range}!cmd does. Nothing is staged in
+ * a temporary file or a string of the whole range:
+ *
+ *   - the rows are written to the command's stdin straight from the
+ *     buffer, a batch of rows (and their newlines) to each uv_write(), a
+ *     writev(), with at most FILTER_WRITE_AHEAD bytes in flight;
+ *   - rows written are deleted from the buffer as the command takes them;
+ *   - its output is read as it comes, and filter_tick(), run by the main
+ *     loop, inserts the complete lines read so far where the rows were.
+ *
+ * Each of these edits moves the rows below it once, so they are made no
+ * more often than needed for that to cost a few times the rows they
+ * move: for :%!sort the rows read back go in as they come, and the input
+ * rows go out in batches that grow with what is left of them. Reading
+ * stops while FILTER_OUT_MAX bytes wait to go in, and the command with
+ * it, until the main loop catches up.
+ *
+ * The edits are held in one undo group (undo_hold_group()), so the whole
+ * filter is one undo step; the buffer is read-only until it is done (see
+ * editor_refuse_edit()). A command that fails (a non-zero exit) has the
+ * rows put back and its stderr in the status, as does filter_cancel().
+ */
+
+#ifndef LOKI_FILTER_H
+#define LOKI_FILTER_H
+
+#include "internal.h"
+
+/* Bytes written to the command and not yet taken, at most */
+#define FILTER_WRITE_AHEAD ((size_t)1 << 20)
+
+/* Rows per uv_write(), at most */
+#define FILTER_WRITE_ROWS 256
+
+/* Bytes read and waiting to go into the buffer before reading stops */
+#define FILTER_OUT_MAX ((size_t)16 << 20)
+
+/* Bytes of output put into the buffer per tick, at most */
+#define FILTER_APPLY_MAX ((size_t)4 << 20)
+
+typedef struct FilterJob FilterJob;
+
+/* Filter rows first..last through 'cmd'. Returns 0 once the command is
+ * started, or -1 with the reason in the status. */
+int filter_start(editor_ctx_t *ctx, int first, int last, const char *cmd);
+
+/* Stop the filter, killing the command, and put the rows back. Returns 0,
+ * or -1 if the buffer is not being filtered. */
+int filter_cancel(editor_ctx_t *ctx);
+
+/* Stop the filter as the buffer goes: kill the command, leave the rows as
+ * they are. Safe on a model not being filtered. */
+void filter_stop(EditorModel *model);
+
+/* Put what the commands of all filters wrote since into their buffers,
+ * take the rows they read out, and finish the filters that are done.
+ * Returns 0 if output is left to put in, -1 if nothing is until the
+ * commands write more. */
+int filter_tick(void);
+
+#endif /* LOKI_FILTER_H */
@@ -0,0 +1,1310 @@
+/* finder.c - Fuzzy file finder over the project's files
+ *
+ * See finder.h for an overview. The list is an array of paths, shortest
+ * first, with their character masks in an array of their own, so that
+ * the masks of half a million paths, the only thing most queries read of
+ * most paths, are a few megabytes read in order. A walk builds a new list on the task pool
+ * (one at a time) and caches it; the main thread swaps it in when the
+ * walk is taken in, and changes the list itself only on the main thread.
+ */
+
+#define _DEFAULT_SOURCE     /* d_type, realpath(), strdup() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <uv.h>
+#include <stdatomic.h>
+
+#include "finder.h"
+#include "grep.h"
+#include "loader.h"
+#include "task_pool.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define FINDER_MAGIC "LOKIFIL1"
+#define FINDER_VERSION 1
+
+/* Scores of a character matched, and what it gains for running on from
+ * the last, starting a part of the path, being in the file name, or
+ * starting it */
+#define SCORE_CHAR 16
+#define SCORE_RUN 16
+#define SCORE_PART 12
+#define SCORE_NAME 4
+#define SCORE_NAME_START 8
+
+/* Parts a query is scored in, at most */
+#define FINDER_MAX_PARTS (TASK_POOL_MAX_THREADS + 1)
+
+/* Paths sketched together, for the bound of them all */
+#define FINDER_BLOCK 64
+
+/* The cache file: a FileHeader, then 'count' FileRec, and the strings
+ * they point into */
+typedef struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t strings_size;
+    uint64_t reserved;
+} FileHeader;
+
+typedef struct FileRec {
+    uint32_t off;           /* Of the path in the strings */
+    uint32_t len;
+    uint64_t mask;
+} FileRec;
+
+/* A path of the list. Not NUL-terminated. */
+typedef struct Entry {
+    const char *path;
+    const char *folded;     /* The path case folded ('path' if it is) */
+    uint32_t len;
+    uint16_t base;          /* Where the file name starts */
+} Entry;
+
+/* What a path, or a block of FINDER_BLOCK paths, can score, in bits of
+ * char_bit() and pair_bit() (see bound()) */
+typedef struct Sketch {
+    uint64_t name;          /* The characters of the file name */
+    uint64_t parts;         /* Those starting a part of the path */
+    uint64_t pairs;         /* The pairs of characters next to each other */
+    uint64_t first;         /* The file name's first character */
+    uint64_t camel;         /* Upper case letters after lower case ones */
+} Sketch;
+
+/* The list, and what holds its strings */
+typedef struct PathList {
+    Entry *e;
+    uint64_t *mask;         /* By entry: chars_mask() of the path */
+    Sketch *sketch;         /* By entry */
+    Sketch *block;          /* By FINDER_BLOCK entries: their sketches or'ed */
+    uint32_t n, cap;
+    LoadedFile cache;       /* The cached list's strings, when loaded */
+    char *strings;          /* A walked list's strings */
+    char *folded;           /* Folded copies of the paths with upper case */
+    char **owned;           /* Paths added since, and their folded copies */
+    int nowned, owned_cap;
+} PathList;
+
+/* A walk, on the task pool */
+typedef struct FindWalk {
+    int id;
+    PathList list;          /* What it found */
+    int pooled;             /* Runs on the pool, and reports with an event */
+    Task *task;
+    atomic_int cancel;
+    atomic_int joining;     /* finish_walk() waits: no event needed */
+} FindWalk;
+
+static struct {
+    char *root;             /* As given; NULL when closed */
+    char *real;             /* realpath() of the root */
+    PathList list;
+    GrepIgnore *ignore;     /* For the marks */
+    uint32_t gen;           /* Bumped as the list changes */
+    int dirty;              /* Changed since it was cached */
+    char **marked;          /* Paths to look at, relative to the root */
+    int nmarked, marked_cap;
+    uint64_t marked_at;     /* uv_hrtime() of the last mark */
+    int walk_wanted;
+    FindWalk *job;
+    int next_id;
+    uv_fs_event_t *watch;   /* Freed once closed; NULL if none */
+    /* The last query scored (folded), and the positions in the list of
+     * the paths that may match it (every one that does), in order, and of
+     * its best, while the list is at 'hits_gen' */
+    char last[FINDER_MAX_QUERY + 1];
+    size_t last_len;
+    uint32_t *hits;
+    uint32_t nhits;
+    uint32_t *shown;
+    int nshown;
+    uint32_t hits_gen;
+    int have_hits;
+} fnd;
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+/* ======================== Characters ======================== */
+
+static int fold(int c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* One of 64 bits for a character, case folded: letters and digits have
+ * their own, the rest share */
+static uint64_t char_bit(int c) {
+    c = fold((unsigned char)c);
+    if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+    if (c == '_') return 1ULL << 36;
+    if (c == '.') return 1ULL << 37;
+    if (c == '/') return 1ULL << 38;
+    if (c == '-') return 1ULL << 39;
+    return 1ULL << (40 + (unsigned char)c % 24);
+}
+
+static uint64_t chars_mask(const char *s, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) mask |= char_bit(s[i]);
+    return mask;
+}
+
+/* One of 64 bits for two folded characters next to each other */
+static uint64_t pair_bit(int a, int b) {
+    uint32_t h = ((uint32_t)(unsigned char)a << 8 | (unsigned char)b) * 2654435761u;
+    return 1ULL << (h >> 26);
+}
+
+static int separates_parts(int c);
+static int starts_part(const char *p, uint32_t i);
+
+/* ======================== The list ======================== */
+
+static void list_free(PathList *l) {
+    free(l->e);
+    free(l->mask);
+    free(l->sketch);
+    free(l->block);
+    loader_close(&l->cache);
+    free(l->strings);
+    free(l->folded);
+    for (int i = 0; i < l->nowned; i++) free(l->owned[i]);
+    free(l->owned);
+    memset(l, 0, sizeof(*l));
+}
+
+static void sketch_or(Sketch *to, const Sketch *sk) {
+    to->name |= sk->name;
+    to->parts |= sk->parts;
+    to->pairs |= sk->pairs;
+    to->first |= sk->first;
+    to->camel |= sk->camel;
+}
+
+/* Sketch the blocks from the one holding entry 'from' on again */
+static void blocks_update(PathList *l, uint32_t from) {
+    for (uint32_t b = from / FINDER_BLOCK; b * FINDER_BLOCK < l->n; b++) {
+        memset(&l->block[b], 0, sizeof(l->block[b]));
+        for (uint32_t i = b * FINDER_BLOCK; i < l->n && i < (b + 1) * FINDER_BLOCK; i++)
+            sketch_or(&l->block[b], &l->sketch[i]);
+    }
+}
+
+/* Add a path after those no longer than it */
+static void list_push(PathList *l, const char *path, const char *folded,
+                      uint32_t len, uint64_t mask) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->e = xrealloc(l->e, sizeof(*l->e) * l->cap);
+        l->mask = xrealloc(l->mask, sizeof(*l->mask) * l->cap);
+        l->sketch = xrealloc(l->sketch, sizeof(*l->sketch) * l->cap);
+        l->block = xrealloc(l->block, sizeof(*l->block) * (l->cap / FINDER_BLOCK + 1));
+    }
+    uint32_t at = l->n;
+    if (at > 0 && l->e[at - 1].len > len) {
+        uint32_t lo = 0;
+        while (lo < at) {
+            uint32_t mid = lo + (at - lo) / 2;
+            if (l->e[mid].len <= len) lo = mid + 1;
+            else at = mid;
+        }
+        memmove(l->e + at + 1, l->e + at, sizeof(*l->e) * (l->n - at));
+        memmove(l->mask + at + 1, l->mask + at, sizeof(*l->mask) * (l->n - at));
+        memmove(l->sketch + at + 1, l->sketch + at, sizeof(*l->sketch) * (l->n - at));
+    }
+    uint32_t base = len;
+    while (base > 0 && path[base - 1] != '/') base--;
+    l->e[at].path = path;
+    l->e[at].folded = folded;
+    l->e[at].len = len;
+    l->e[at].base = (uint16_t)base;
+    l->mask[at] = mask;
+
+    Sketch *sk = &l->sketch[at];
+    sk->name = chars_mask(folded + base, len - base);
+    sk->parts = sk->pairs = sk->camel = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (!starts_part(path, i)) continue;
+        sk->parts |= char_bit(folded[i]);
+        if (i > 0 && !separates_parts((unsigned char)path[i - 1]))
+            sk->camel |= char_bit(folded[i]);
+    }
+    for (uint32_t i = 1; i < len; i++) sk->pairs |= pair_bit(folded[i - 1], folded[i]);
+    sk->first = base < len ? char_bit(folded[base]) : 0;
+    if (at % FINDER_BLOCK == 0) memset(&l->block[at / FINDER_BLOCK], 0, sizeof(*sk));
+    l->n++;
+    if (at == l->n - 1) sketch_or(&l->block[at / FINDER_BLOCK], sk);
+    else blocks_update(l, at);
+}
+
+static int has_upper(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] >= 'A' && s[i] <= 'Z') return 1;
+    return 0;
+}
+
+static void fold_copy(char *dst, const char *src, size_t len) {
+    for (size_t i = 0; i < len; i++) dst[i] = (char)fold((unsigned char)src[i]);
+}
+
+/* Add the paths of 'count' records whose strings are at 'strings', with
+ * folded copies of those that need one, shortest first. Records pointing
+ * out of the strings are left out. If the strings are the list's own (a
+ * walked list's), they are laid out again in its order, so that scoring
+ * reads them in order (a cached list's are written so). */
+static void list_add_recs(PathList *l, const FileRec *recs, uint32_t count,
+                          const char *strings, uint64_t strings_size) {
+    /* The records by length (a counting sort, keeping their order) */
+    uint32_t *by_len = malloc(sizeof(*by_len) * (count ? count : 1));
+    uint32_t *start = calloc((size_t)UINT16_MAX + 2, sizeof(*start));
+    if (!by_len || !start) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        if (recs[i].len <= UINT16_MAX) start[recs[i].len + 1]++;
+    for (uint32_t len = 0; len <= UINT16_MAX; len++) start[len + 1] += start[len];
+    uint32_t nsorted = start[UINT16_MAX + 1];
+    for (uint32_t i = 0; i < count; i++)
+        if (recs[i].len <= UINT16_MAX) by_len[start[recs[i].len]++] = i;
+    free(start);
+
+    size_t need = 0, total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((uint64_t)recs[i].off + recs[i].len > strings_size) continue;
+        total += recs[i].len;
+        if (has_upper(strings + recs[i].off, recs[i].len)) need += recs[i].len;
+    }
+    char *own = strings == l->strings ? l->strings : NULL;
+    char *folded = need ? malloc(need) : NULL;
+    char *laid = own && total ? malloc(total) : NULL;
+    if ((need && !folded) || (own && total && !laid)) {
+        perror("Out of memory");
+        exit(1);
+    }
+    free(l->folded);
+    l->folded = folded;
+    if (laid) l->strings = laid;
+    for (uint32_t k = 0; k < nsorted; k++) {
+        const FileRec *r = &recs[by_len[k]];
+        if (r->len == 0 || (uint64_t)r->off + r->len > strings_size)
+            continue;
+        const char *path = strings + r->off;
+        if (laid) {
+            memcpy(laid, path, r->len);
+            path = laid;
+            laid += r->len;
+        }
+        const char *f = path;
+        if (has_upper(path, r->len)) {
+            fold_copy(folded, path, r->len);
+            f = folded;
+            folded += r->len;
+        }
+        list_push(l, path, f, r->len, r->mask);
+    }
+    free(by_len);
+    if (laid) free(own);
+}
+
+/* Read the list cached at 'path' into 'l'. Returns 0, or -1 if there is
+ * none, or not one this version reads. */
+static int list_load(PathList *l, const char *path) {
+    memset(l, 0, sizeof(*l));
+    if (loader_open(path, &l->cache) != 0) return -1;
+    const FileHeader *h = (const FileHeader *)l->cache.data;
+    if (l->cache.size < sizeof(*h) ||
+        memcmp(h->magic, FINDER_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != FINDER_VERSION ||
+        sizeof(*h) + (uint64_t)h->count * sizeof(FileRec) + h->strings_size !=
+            l->cache.size) {
+        loader_close(&l->cache);
+        return -1;
+    }
+    const FileRec *recs = (const FileRec *)(h + 1);
+    list_add_recs(l, recs, h->count, (const char *)(recs + h->count),
+                  h->strings_size);
+    return 0;
+}
+
+/* Cache 'l' in .loki/files under 'root' (a temporary file renamed over
+ * it). Returns 0, or -1 if it could not be written. */
+static int list_write(const PathList *l, const char *root) {
+    FileRec *recs = malloc(sizeof(*recs) * (l->n ? l->n : 1));
+    if (!recs) {
+        perror("Out of memory");
+        exit(1);
+    }
+    uint64_t strings = 0;
+    for (uint32_t i = 0; i < l->n; i++) {
+        recs[i].off = (uint32_t)strings;
+        recs[i].len = l->e[i].len;
+        recs[i].mask = l->mask[i];
+        strings += l->e[i].len;
+    }
+
+    char dir[PATH_MAX], tmp[PATH_MAX], path[PATH_MAX];
+    int ok = strings <= UINT32_MAX &&
+             snprintf(dir, sizeof(dir), "%s/.loki", root) < (int)sizeof(dir) &&
+             snprintf(tmp, sizeof(tmp), "%s/files.%ld.tmp", dir,
+                      (long)getpid()) < (int)sizeof(tmp) &&
+             snprintf(path, sizeof(path), "%s/files", dir) < (int)sizeof(path) &&
+             (mkdir(dir, 0755) == 0 || errno == EEXIST);
+    FILE *fp = ok ? fopen(tmp, "wb") : NULL;
+    if (fp) {
+        FileHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, FINDER_MAGIC, sizeof(h.magic));
+        h.version = FINDER_VERSION;
+        h.count = l->n;
+        h.strings_size = strings;
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             fwrite(recs, sizeof(*recs), l->n, fp) == l->n;
+        for (uint32_t i = 0; ok && i < l->n; i++)
+            ok = fwrite(l->e[i].path, 1, l->e[i].len, fp) == l->e[i].len;
+        ok = fclose(fp) == 0 && ok;
+        if (ok) ok = rename(tmp, path) == 0;
+        if (!ok) unlink(tmp);
+    } else {
+        ok = 0;
+    }
+    free(recs);
+    return ok ? 0 : -1;
+}
+
+static int find_path(const char *rel, size_t len) {
+    for (uint32_t i = 0; i < fnd.list.n; i++)
+        if (fnd.list.e[i].len == len && memcmp(fnd.list.e[i].path, rel, len) == 0)
+            return (int)i;
+    return -1;
+}
+
+static void changed(void) {
+    fnd.gen++;
+    fnd.dirty = 1;
+}
+
+/* ======================== Walking ======================== */
+
+/* A walk's paths, as cache records until it is done */
+typedef struct Walk {
+    FindWalk *job;
+    GrepIgnore *ignore;
+    FileRec *recs;
+    uint32_t count, cap;
+    char *strings;
+    size_t len, strings_cap;
+} Walk;
+
+/* Add the files under the directory 'rel' ("" for the root). */
+static void walk_dir(Walk *w, const char *rel) {
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s%s%s", fnd.real, *rel ? "/" : "",
+                 rel) >= (int)sizeof(full))
+        return;
+    DIR *d = opendir(full);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && !atomic_load(&w->job->cancel)) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+            (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+            continue;
+        char path[PATH_MAX];
+        int len = snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "",
+                           de->d_name);
+        if (len >= (int)sizeof(path)) continue;
+
+        /* Symlinks are not followed; the type costs a stat only where the
+         * file system does not give it */
+        int is_dir = de->d_type == DT_DIR, is_reg = de->d_type == DT_REG;
+        if (de->d_type == DT_UNKNOWN) {
+            char abs[PATH_MAX];
+            struct stat st;
+            if (snprintf(abs, sizeof(abs), "%s/%s", fnd.real, path) >= (int)sizeof(abs) ||
+                lstat(abs, &st) != 0)
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_reg = S_ISREG(st.st_mode);
+        }
+        if (!is_dir && !is_reg) continue;
+        if (grep_ignore_match(w->ignore, path, is_dir)) continue;
+        if (is_dir) {
+            walk_dir(w, path);
+            continue;
+        }
+
+        if (w->count == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 4096;
+            w->recs = xrealloc(w->recs, sizeof(*w->recs) * w->cap);
+        }
+        if (w->len + (size_t)len > w->strings_cap) {
+            w->strings_cap = w->strings_cap ? w->strings_cap * 2 : 65536;
+            while (w->len + (size_t)len > w->strings_cap) w->strings_cap *= 2;
+            w->strings = xrealloc(w->strings, w->strings_cap);
+        }
+        FileRec *r = &w->recs[w->count++];
+        r->off = (uint32_t)w->len;
+        r->len = (uint32_t)len;
+        r->mask = chars_mask(path, (size_t)len);
+        memcpy(w->strings + w->len, path, (size_t)len);
+        w->len += (size_t)len;
+    }
+    closedir(d);
+}
+
+static void walk_event_handler(AsyncEvent *event, void *unused);
+static void start_next(uint64_t now);
+
+static void push_walk_event(FindWalk *job) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = FINDER_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+
+    /* Completion must not be lost; wait for room in the queue, unless
+     * finish_walk() is waiting for us: then the main thread isn't
+     * draining it, and takes the list in itself */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&job->joining)) return;
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+    }
+}
+
+static void walk_worker(void *arg) {
+    FindWalk *job = arg;
+    Walk w;
+    memset(&w, 0, sizeof(w));
+    w.job = job;
+    w.ignore = grep_ignore_load(fnd.real);
+    if (!w.ignore) {
+        perror("Out of memory");
+        exit(1);
+    }
+    grep_ignore_add(w.ignore, "/.loki/");
+    walk_dir(&w, "");
+    grep_ignore_free(w.ignore);
+
+    if (!atomic_load(&job->cancel) && w.len <= UINT32_MAX) {
+        job->list.strings = w.strings;
+        w.strings = NULL;
+        list_add_recs(&job->list, w.recs, w.count, job->list.strings, w.len);
+        list_write(&job->list, fnd.real);
+    }
+    free(w.recs);
+    free(w.strings);
+    /* Run by finish_walk() itself, on the thread draining the queue */
+    if (job->pooled && !atomic_load(&job->joining)) push_walk_event(job);
+}
+
+/* Main thread: wait for the walk and take its list in. */
+static void finish_walk(void) {
+    FindWalk *job = fnd.job;
+    atomic_store(&job->joining, 1);
+    if (job->task) task_wait(job->task);
+    fnd.job = NULL;
+    if (!atomic_load(&job->cancel)) {
+        list_free(&fnd.list);
+        fnd.list = job->list;
+        fnd.gen++;
+        fnd.dirty = 0;
+        /* With what .gitignore says now */
+        GrepIgnore *ig = grep_ignore_load(fnd.real);
+        if (ig) {
+            grep_ignore_add(ig, "/.loki/");
+            grep_ignore_free(fnd.ignore);
+            fnd.ignore = ig;
+        }
+    } else {
+        list_free(&job->list);
+    }
+    free(job);
+}
+
+static void walk_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    if (fnd.job && fnd.job->id == (int)event->data.user.i64[0]) {
+        finish_walk();
+        start_next(uv_hrtime());
+    }
+}
+
+/* Walk on the pool, or here without an event queue to report it. */
+static void start_walk(void) {
+    FindWalk *job = calloc(1, sizeof(*job));
+    if (!job) {
+        perror("Out of memory");
+        exit(1);
+    }
+    job->id = ++fnd.next_id;
+    atomic_init(&job->cancel, 0);
+    atomic_init(&job->joining, 0);
+    fnd.job = job;
+    fnd.walk_wanted = 0;
+    if (async_queue_global() != NULL) {
+        if (async_queue_get_handler(NULL, FINDER_ASYNC_EVENT) != walk_event_handler) {
+            async_queue_set_handler_lane(NULL, FINDER_ASYNC_EVENT,
+                                         walk_event_handler, ASYNC_LANE_LOW);
+            async_event_set_type_name(FINDER_ASYNC_EVENT, "finder");
+        }
+        job->pooled = 1;
+        job->task = task_submit(walk_worker, job, TASK_PRIORITY_LOW, NULL);
+        job->pooled = job->task != NULL;
+    }
+    if (!job->pooled) {
+        walk_worker(job);
+        finish_walk();
+    }
+}
+
+/* ======================== Marks ======================== */
+
+/* Whether 'rel' or a directory it is under is skipped */
+static int ignored(const char *rel, int is_dir) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", rel);
+    for (char *s = strchr(buf, '/'); s; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        int hit = grep_ignore_match(fnd.ignore, buf, 1);
+        *s = '/';
+        if (hit) return 1;
+    }
+    return grep_ignore_match(fnd.ignore, rel, is_dir);
+}
+
+/* Drop 'rel' and the paths under it, keeping the others in order */
+static void drop_path(const char *rel, size_t len) {
+    PathList *l = &fnd.list;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < l->n; i++) {
+        const Entry *e = &l->e[i];
+        if (e->len >= len && memcmp(e->path, rel, len) == 0 &&
+            (e->len == len || e->path[len] == '/'))
+            continue;
+        l->e[n] = l->e[i];
+        l->mask[n] = l->mask[i];
+        l->sketch[n] = l->sketch[i];
+        n++;
+    }
+    if (n < l->n) {
+        l->n = n;
+        blocks_update(l, 0);
+        changed();
+    }
+}
+
+/* Whether a path of the list is under the directory 'rel' */
+static int has_under(const char *rel, size_t len) {
+    for (uint32_t i = 0; i < fnd.list.n; i++) {
+        const Entry *e = &fnd.list.e[i];
+        if (e->len > len && e->path[len] == '/' && memcmp(e->path, rel, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Look at a marked path again */
+static void look_at(const char *rel) {
+    char abs[PATH_MAX];
+    if (snprintf(abs, sizeof(abs), "%s/%s", fnd.real, rel) >= (int)sizeof(abs))
+        return;
+    size_t len = strlen(rel);
+    struct stat st;
+    if (lstat(abs, &st) != 0) {
+        drop_path(rel, len);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        /* A directory new to the list is walked for what it holds */
+        if (!ignored(rel, 1) && !has_under(rel, len)) fnd.walk_wanted = 1;
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || ignored(rel, 0) || find_path(rel, len) >= 0)
+        return;
+    PathList *l = &fnd.list;
+    if (l->nowned + 2 > l->owned_cap) {
+        l->owned_cap = l->owned_cap ? l->owned_cap * 2 : 16;
+        l->owned = xrealloc(l->owned, sizeof(*l->owned) * (size_t)l->owned_cap);
+    }
+    char *path = strdup(rel);
+    if (!path) {
+        perror("Out of memory");
+        exit(1);
+    }
+    l->owned[l->nowned++] = path;
+    char *f = path;
+    if (has_upper(path, len)) {
+        f = strdup(path);
+        if (!f) {
+            perror("Out of memory");
+            exit(1);
+        }
+        fold_copy(f, path, len);
+        l->owned[l->nowned++] = f;
+    }
+    list_push(l, path, f, (uint32_t)len, chars_mask(path, len));
+    changed();
+}
+
+static void free_marks(void) {
+    for (int i = 0; i < fnd.nmarked; i++) free(fnd.marked[i]);
+    fnd.nmarked = 0;
+}
+
+/* Start what is due at 'now', if no walk runs: the marks, then a walk */
+static void start_next(uint64_t now) {
+    if (fnd.root == NULL || fnd.job) return;
+    if (fnd.nmarked > 0 &&
+        now >= fnd.marked_at + (uint64_t)FINDER_SETTLE_MS * 1000000) {
+        if (fnd.nmarked > FINDER_MARKS_WALK) fnd.walk_wanted = 1;
+        else for (int i = 0; i < fnd.nmarked; i++) look_at(fnd.marked[i]);
+        free_marks();
+    }
+    if (fnd.walk_wanted) start_walk();
+}
+
+static void mark(const char *rel) {
+    fnd.marked_at = uv_hrtime();
+    if (fnd.nmarked > FINDER_MARKS_WALK) return;     /* A walk anyway */
+    for (int i = 0; i < fnd.nmarked; i++)
+        if (strcmp(fnd.marked[i], rel) == 0) return;
+    if (fnd.nmarked == fnd.marked_cap) {
+        fnd.marked_cap = fnd.marked_cap ? fnd.marked_cap * 2 : 16;
+        fnd.marked = xrealloc(fnd.marked, sizeof(*fnd.marked) * (size_t)fnd.marked_cap);
+    }
+    fnd.marked[fnd.nmarked] = strdup(rel);
+    if (!fnd.marked[fnd.nmarked]) {
+        perror("Out of memory");
+        exit(1);
+    }
+    fnd.nmarked++;
+}
+
+static void on_watch(uv_fs_event_t *handle, const char *name, int events,
+                     int status) {
+    (void)handle;
+    (void)events;
+    if (status == 0 && name && strncmp(name, ".loki", 5) != 0) mark(name);
+}
+
+static void on_watch_close(uv_handle_t *handle) {
+    free(handle);
+}
+
+/* ======================== Scoring ======================== */
+
+static int separates_parts(int c) {
+    return c == '/' || c == '_' || c == '-' || c == '.' || c == ' ';
+}
+
+static int is_letter(int c) {
+    c = fold(c);
+    return c >= 'a' && c <= 'z';
+}
+
+/* Whether a part of the path starts at 'i': after a separator, or an
+ * upper case letter after a lower case one */
+static int starts_part(const char *p, uint32_t i) {
+    if (i == 0) return 1;
+    int a = (unsigned char)p[i - 1], c = (unsigned char)p[i];
+    if (separates_parts(a)) return 1;
+    return c >= 'A' && c <= 'Z' && a >= 'a' && a <= 'z';
+}
+
+/* path_score() of a path that matches, but can't score 'floor' */
+#define SCORE_BEATEN (-2)
+
+/* How the character of a query can start a part of the path running on
+ * from the one before it */
+enum { RUN_NO_PART, RUN_PART, RUN_PART_IF_CAMEL };
+
+/* A query, folded, and what a path can score for it at most */
+typedef struct Query {
+    const char *q;
+    size_t qlen;
+    size_t name_from;       /* After its last '/': what a file name can hold */
+    uint64_t need;          /* chars_mask() of the query */
+    uint64_t need_name;     /* chars_mask() of what a file name can hold */
+    uint64_t name_first;    /* char_bit() of the first of it */
+    int name_top;           /* What it has for the file name */
+    uint64_t bit[FINDER_MAX_QUERY];     /* char_bit() of each character */
+    uint64_t pair[FINDER_MAX_QUERY];    /* pair_bit() of it and the one before */
+    unsigned char run_part[FINDER_MAX_QUERY];   /* RUN_* */
+} Query;
+
+/* Score the query as a subsequence of the path from 'from' on, or -1 if
+ * it is not one. The match is the one ending first, starting as late as
+ * it can (so "fb" in "foo/bar/fb.c" is the "fb" of the file name).
+ * Characters are found with memchr() in the folded path, which the C
+ * library does many bytes at a time. As the match is found, what it can
+ * score at most comes down from 'top' ('top_out' if it ends before the
+ * file name); once that is under 'floor', it is SCORE_BEATEN without
+ * being scored. */
+static int score_from(const Entry *e, uint32_t from, const Query *qy, int top,
+                      int top_out, int floor) {
+    const char *f = e->folded, *p = e->path, *q = qy->q;
+    size_t qlen = qy->qlen;
+    uint32_t len = e->len, i = from;
+    for (size_t k = 0; k < qlen; k++) {
+        const char *hit = i < len ? memchr(f + i, q[k], len - i) : NULL;
+        if (hit == NULL) return -1;
+        i = (uint32_t)(hit - f) + 1;
+    }
+    uint32_t end = --i;
+    if (end < e->base) top = top_out;
+    if (top < floor) return SCORE_BEATEN;
+    for (size_t k = qlen;; i--)
+        if (f[i] == q[k - 1] && --k == 0) break;
+    uint32_t start = i;
+    if (top - (int)(end - start + 1 - qlen) < floor) return SCORE_BEATEN;
+
+    int score = 0;
+    uint32_t last = start;
+    for (size_t k = 0; i <= end; i++) {
+        if (f[i] != q[k]) continue;
+        int s = SCORE_CHAR;
+        if (k > 0 && last + 1 == i) s += SCORE_RUN;
+        if (starts_part(p, i)) s += SCORE_PART;
+        if (i >= e->base) s += i == e->base ? SCORE_NAME + SCORE_NAME_START : SCORE_NAME;
+        score += s;
+        last = i;
+        if (++k == qlen) break;
+    }
+    /* Characters skipped between the first and the last matched */
+    return score - (int)(end - start + 1 - qlen);
+}
+
+/* The match in the file name if there is one (which its sketch 'sk' may
+ * rule out), else the one in the path */
+static int path_score(const Entry *e, const Sketch *sk, const Query *qy, int top,
+                      int top_out, int floor) {
+    if (qy->qlen == 0) return 0;
+    int s = e->base > 0 && (sk->name & qy->need) == qy->need ?
+            score_from(e, e->base, qy, top, top_out, floor) : -1;
+    return s != -1 ? s : score_from(e, 0, qy, top, top_out, floor);
+}
+
+/* Fold the query 'q' into 'qy', with what bound() needs of it */
+static void query_init(Query *qy, const char *q, size_t qlen) {
+    qy->q = q;
+    qy->qlen = qlen;
+    size_t from = qlen;
+    while (from > 0 && q[from - 1] != '/') from--;
+    qy->name_from = from;
+    qy->need = chars_mask(q, qlen);
+    qy->need_name = chars_mask(q + from, qlen - from);
+    qy->name_first = from < qlen ? char_bit(q[from]) : 0;
+    qy->name_top = from < qlen ? (int)(qlen - from) * SCORE_NAME + SCORE_NAME_START : 0;
+    for (size_t k = 0; k < qlen; k++) {
+        qy->bit[k] = char_bit(q[k]);
+        qy->pair[k] = k > 0 ? pair_bit(q[k - 1], q[k]) : 0;
+        int a = k > 0 ? (unsigned char)q[k - 1] : 0, c = (unsigned char)q[k];
+        qy->run_part[k] = k > 0 && separates_parts(a) ? RUN_PART :
+                          k > 0 && is_letter(a) && is_letter(c) ? RUN_PART_IF_CAMEL :
+                          RUN_NO_PART;
+    }
+}
+
+/* The most a path with sketch 'sk' (or a block of them) can score for
+ * the query, and in 'top_out', with the match out of the file name. Each
+ * character scores the most of the bonuses the sketch allows it: running
+ * on from the one before if the pair is ever next to each other (starting
+ * a part too after a separator, or if it starts one in camel case), or
+ * else starting a part if it ever does. The name bonus goes to those a
+ * file name can hold after the last the name lacks, and the bonus for
+ * starting the name to the first of them, or (for one name bonus less)
+ * the next, if the name starts with it. Characters sharing a bit only
+ * make it higher. */
+static int bound(const Query *qy, const Sketch *sk, int *top_out) {
+    int top = 0;
+    size_t in_name = qy->name_from;
+    for (size_t k = 0; k < qy->qlen; k++) {
+        uint64_t bit = qy->bit[k];
+        int best = sk->parts & bit ? SCORE_PART : 0;
+        if (sk->pairs & qy->pair[k]) {
+            int run = SCORE_RUN;
+            if (qy->run_part[k] == RUN_PART ||
+                (qy->run_part[k] == RUN_PART_IF_CAMEL && (sk->camel & bit)))
+                run += SCORE_PART;
+            if (run > best) best = run;
+        }
+        top += SCORE_CHAR + best;
+        if (k >= in_name && !(sk->name & bit)) in_name = k + 1;
+    }
+    *top_out = top;
+    if (in_name < qy->qlen) {
+        top += (int)(qy->qlen - in_name) * SCORE_NAME;
+        if (sk->first & qy->bit[in_name]) top += SCORE_NAME_START;
+        else if (in_name + 1 < qy->qlen && (sk->first & qy->bit[in_name + 1]))
+            top += SCORE_NAME_START - SCORE_NAME;
+    }
+    return top;
+}
+
+typedef struct Cand {
+    uint32_t at;            /* In the list */
+    int score;
+} Cand;
+
+/* Whether a path scored 'sa' goes before one scored 'sb': the higher
+ * score, then the shorter path, then the first in byte order */
+static int better(const Entry *a, int sa, const Entry *b, int sb) {
+    if (sa != sb) return sa > sb;
+    if (a->len != b->len) return a->len < b->len;
+    return memcmp(a->path, b->path, a->len) < 0;
+}
+
+/* Keep the 'max' best in 'best' */
+static void keep(Cand *best, int *n, int max, uint32_t at, int score) {
+    const Entry *e = fnd.list.e;
+    int i = *n;
+    if (i == max) {
+        const Cand *worst = &best[max - 1];
+        if (!better(&e[at], score, &e[worst->at], worst->score)) return;
+        i--;
+    } else {
+        (*n)++;
+    }
+    while (i > 0 && better(&e[at], score, &e[best[i - 1].at], best[i - 1].score)) {
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i].at = at;
+    best[i].score = score;
+}
+
+/* Paths scored by one task: positions from..to of 'subset', or of the
+ * list without one */
+typedef struct Part {
+    const Query *qy;
+    const int *block_top;   /* bound() of each block */
+    const int *rest_top;    /* The highest of the block's and those after */
+    const uint32_t *subset;
+    uint32_t from, to;
+    Cand *best;
+    int nbest, max;
+    int floor;              /* The worst of paths scored before, if enough */
+    uint32_t floor_end;     /* Where paths longer than its own start */
+    uint32_t *hits;         /* The paths that may match, in order */
+    uint32_t nhits;
+    uint32_t *later;        /* Those put off, by where in 'hits' */
+    int *later_top;         /* And their bound() */
+    uint32_t nlater;
+} Part;
+
+/* Where the paths longer than the one at 'at' start (the list is
+ * shortest first) */
+static uint32_t longer_from(uint32_t at) {
+    const Entry *e = fnd.list.e;
+    uint32_t len = e[at].len, lo = at, hi = fnd.list.n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (e[mid].len <= len) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Whether a path at 'at' scoring at most 'top' can't go in the best,
+ * 'worst' being the score of its last (INT_MIN until it is full) */
+#define BEATEN(worst, worst_end, at, top) \
+    ((worst) > (top) || ((worst) == (top) && (at) >= (worst_end)))
+
+/* Whether a path that scored 'score' at 'at' makes the worst of the
+ * best (or the floor) higher */
+static void raise_worst(const Cand *best, int nbest, int max, int *worst,
+                        uint32_t *worst_end) {
+    if (nbest < max) return;
+    int score = best[max - 1].score;
+    if (score < *worst) return;
+    uint32_t end = longer_from(best[max - 1].at);
+    if (score > *worst || end < *worst_end) {
+        *worst = score;
+        *worst_end = end;
+    }
+}
+
+/* Go through the part's paths, shortest first, each only if the bound()
+ * of its block, then its own, could put it in the best. Once no block
+ * from a path's on could put one in, the part ends there, keeping the
+ * paths left as ones that may match. A path that could score what the
+ * paths left could is scored now; the others are put off for
+ * score_later(), which goes through them highest bound first. The paths
+ * that may match are kept in 'hits', as those that don't are found. */
+static void score_part(void *arg) {
+    Part *p = arg;
+    const Query *qy = p->qy;
+    const uint64_t *mask = fnd.list.mask;
+    const Sketch *sketch = fnd.list.sketch;
+    const int *block_top = p->block_top, *rest_top = p->rest_top;
+    const uint32_t *subset = p->subset;
+    uint64_t need = qy->need;
+    uint32_t *hits = p->hits, nhits = 0, worst_end = p->floor_end, k;
+    int worst = p->floor, high = INT_MIN;
+    p->later = malloc(sizeof(*p->later) * (p->to - p->from + 1));
+    p->later_top = malloc(sizeof(*p->later_top) * (p->to - p->from + 1));
+    p->nlater = 0;
+    if (!p->later || !p->later_top) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (k = p->from; k < p->to; k++) {
+        uint32_t at = subset ? subset[k] : k;
+        uint32_t block = at / FINDER_BLOCK;
+        if (BEATEN(worst, worst_end, at, rest_top[block])) break;
+        if ((mask[at] & need) != need) continue;
+        hits[nhits++] = at;
+        if (BEATEN(worst, worst_end, at, block_top[block])) continue;
+        int top_out, top = bound(qy, &sketch[at], &top_out);
+        if (BEATEN(worst, worst_end, at, top)) continue;
+        if (top < high) {
+            p->later[p->nlater] = nhits - 1;
+            p->later_top[p->nlater++] = top;
+            continue;
+        }
+        high = top;
+        int score = path_score(&fnd.list.e[at], &sketch[at], qy, top, top_out,
+                               worst);
+        if (score == -1) {
+            nhits--;
+        } else if (score != SCORE_BEATEN) {
+            keep(p->best, &p->nbest, p->max, at, score);
+            raise_worst(p->best, p->nbest, p->max, &worst, &worst_end);
+        }
+    }
+    for (; k < p->to; k++) hits[nhits++] = subset ? subset[k] : k;
+    p->nhits = nhits;
+}
+
+/* Score the paths the parts put off, highest bound first, into the best
+ * of them all, until the rest can't go in. 'hits' are the parts' joined,
+ * less those found not to match. Returns how many are in the best. */
+static int score_later(const Query *qy, Part *parts, int nparts, uint32_t *hits,
+                       uint32_t *nhits, Cand *best, int n, int max, int floor,
+                       uint32_t floor_end) {
+    int worst = floor, max_top = 0;
+    uint32_t worst_end = floor_end, nlater = 0, off = 0;
+    raise_worst(best, n, max, &worst, &worst_end);
+    for (int i = 0; i < nparts; i++) {
+        Part *p = &parts[i];
+        for (uint32_t k = 0; k < p->nlater; k++) {
+            p->later[k] += off;                 /* Where in the joined hits */
+            if (p->later_top[k] > max_top) max_top = p->later_top[k];
+        }
+        off += p->nhits;
+        nlater += p->nlater;
+    }
+
+    /* By bound, highest first (a counting sort, keeping their order) */
+    uint32_t *start = calloc((size_t)max_top + 2, sizeof(*start));
+    uint32_t *order = malloc(sizeof(*order) * (nlater + 1));
+    if (!start || !order) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int i = 0; i < nparts; i++)
+        for (uint32_t k = 0; k < parts[i].nlater; k++)
+            start[max_top - parts[i].later_top[k] + 1]++;
+    for (int t = 0; t <= max_top; t++) start[t + 1] += start[t];
+    for (int i = 0; i < nparts; i++)
+        for (uint32_t k = 0; k < parts[i].nlater; k++)
+            order[start[max_top - parts[i].later_top[k]]++] = parts[i].later[k];
+    free(start);
+
+    const Sketch *sketch = fnd.list.sketch;
+    int dropped = 0;
+    for (uint32_t i = 0; i < nlater; i++) {
+        uint32_t at = hits[order[i]];
+        int top_out, top = bound(qy, &sketch[at], &top_out);
+        if (worst > top) break;
+        if (BEATEN(worst, worst_end, at, top)) continue;
+        int score = path_score(&fnd.list.e[at], &sketch[at], qy, top, top_out,
+                               worst);
+        if (score == -1) {
+            hits[order[i]] = UINT32_MAX;
+            dropped = 1;
+        } else if (score != SCORE_BEATEN) {
+            keep(best, &n, max, at, score);
+            raise_worst(best, n, max, &worst, &worst_end);
+        }
+    }
+    free(order);
+    if (dropped) {
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < *nhits; i++)
+            if (hits[i] != UINT32_MAX) hits[kept++] = hits[i];
+        *nhits = kept;
+    }
+    return n;
+}
+
+/* ======================== API ======================== */
+
+int finder_open(const char *root) {
+    char *real = realpath(root, NULL);
+    if (real == NULL) return -1;
+    if (fnd.root) {
+        if (strcmp(real, fnd.real) == 0) {
+            free(real);
+            return 0;
+        }
+        finder_close();
+    }
+    fnd.root = strdup(root);
+    fnd.ignore = grep_ignore_load(real);
+    if (!fnd.root || !fnd.ignore) {
+        perror("Out of memory");
+        exit(1);
+    }
+    grep_ignore_add(fnd.ignore, "/.loki/");
+    fnd.real = real;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/.loki/files", real) < (int)sizeof(path))
+        list_load(&fnd.list, path);
+    fnd.gen++;
+    /* Files changed while no one watched */
+    fnd.walk_wanted = 1;
+    start_next(uv_hrtime());
+
+    fnd.watch = malloc(sizeof(*fnd.watch));
+    if (!fnd.watch) {
+        perror("Out of memory");
+        exit(1);
+    }
+    if (uv_fs_event_init(uv_default_loop(), fnd.watch) != 0) {
+        free(fnd.watch);
+        fnd.watch = NULL;
+    } else if (uv_fs_event_start(fnd.watch, on_watch, fnd.real,
+                                  UV_FS_EVENT_RECURSIVE) != 0) {
+        uv_fs_event_start(fnd.watch, on_watch, fnd.real, 0);
+    }
+    return 0;
+}
+
+const char *finder_root(void) {
+    return fnd.root;
+}
+
+void finder_close(void) {
+    if (fnd.root == NULL) return;
+    if (fnd.job) {
+        atomic_store(&fnd.job->cancel, 1);
+        finish_walk();
+    }
+    if (fnd.dirty) list_write(&fnd.list, fnd.real);
+
+    if (fnd.watch) uv_close((uv_handle_t *)fnd.watch, on_watch_close);
+    list_free(&fnd.list);
+    grep_ignore_free(fnd.ignore);
+    free_marks();
+    free(fnd.marked);
+    free(fnd.hits);
+    free(fnd.shown);
+    free(fnd.root);
+    free(fnd.real);
+    int next_id = fnd.next_id;
+    uint32_t gen = fnd.gen;
+    memset(&fnd, 0, sizeof(fnd));
+    fnd.next_id = next_id;
+    fnd.gen = gen + 1;
+}
+
+int finder_refresh(void) {
+    if (fnd.root == NULL) return -1;
+    fnd.walk_wanted = 1;
+    start_next(uv_hrtime());
+    return 0;
+}
+
+void finder_note_file(const char *path) {
+    if (fnd.root == NULL || path == NULL) return;
+    /* The directory, as the file may be gone */
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    char *d = realpath(dir, NULL);
+    if (d == NULL) return;
+    char real[PATH_MAX];
+    int n = snprintf(real, sizeof(real), "%s/%s", d, slash ? slash + 1 : path);
+    free(d);
+    size_t rlen = strlen(fnd.real);
+    if (n < (int)sizeof(real) && strncmp(real, fnd.real, rlen) == 0 &&
+        real[rlen] == '/')
+        mark(real + rlen + 1);
+}
+
+int finder_find(const char *query, FinderMatch *out, int max) {
+    if (fnd.root == NULL) return -1;
+    if (max <= 0 || fnd.list.n == 0) return 0;
+
+    char q[FINDER_MAX_QUERY + 1];
+    size_t qlen = 0;
+    for (; query[qlen] && qlen < FINDER_MAX_QUERY; qlen++)
+        q[qlen] = (char)fold((unsigned char)query[qlen]);
+    q[qlen] = '\0';
+
+    /* Typed on from the last query: only the paths matching it can match */
+    const uint32_t *subset = NULL;
+    uint32_t ncand = fnd.list.n;
+    if (fnd.have_hits && fnd.hits_gen == fnd.gen && fnd.last_len > 0 &&
+        qlen >= fnd.last_len && memcmp(q, fnd.last, fnd.last_len) == 0) {
+        subset = fnd.hits;
+        ncand = fnd.nhits;
+    }
+
+    int nparts = (int)((ncand + FINDER_PART_PATHS - 1) / FINDER_PART_PATHS);
+    int threads = task_pool_threads() + 1;
+    if (nparts > threads) nparts = threads;
+    if (nparts > FINDER_MAX_PARTS) nparts = FINDER_MAX_PARTS;
+    if (nparts < 1) nparts = 1;
+
+    Part parts[FINDER_MAX_PARTS];
+    uint32_t *hits = malloc(sizeof(*hits) * (ncand ? ncand : 1));
+    Cand *best = malloc(sizeof(*best) * (size_t)max * (size_t)(nparts + 1));
+    if (!hits || !best) {
+        perror("Out of memory");
+        exit(1);
+    }
+    Query qy;
+    query_init(&qy, q, qlen);
+    uint32_t nblocks = (fnd.list.n + FINDER_BLOCK - 1) / FINDER_BLOCK;
+    int *block_top = malloc(sizeof(*block_top) * 2 * nblocks);
+    if (!block_top) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int *rest_top = block_top + nblocks;
+    for (uint32_t b = nblocks; b-- > 0; ) {
+        int top_out;
+        block_top[b] = bound(&qy, &fnd.list.block[b], &top_out);
+        rest_top[b] = b + 1 < nblocks && rest_top[b + 1] > block_top[b] ?
+                      rest_top[b + 1] : block_top[b];
+    }
+    /* The last query's best, scored first: the worst of them, if there are
+     * enough, is as good as a path must be from the start */
+    int floor = INT_MIN, nseed = 0;
+    uint32_t floor_end = 0;
+    if (fnd.have_hits && fnd.hits_gen == fnd.gen) {
+        for (int i = 0; i < fnd.nshown; i++) {
+            uint32_t at = fnd.shown[i];
+            int top_out, top = bound(&qy, &fnd.list.sketch[at], &top_out);
+            int score = path_score(&fnd.list.e[at], &fnd.list.sketch[at], &qy,
+                                   top, top_out, INT_MIN);
+            if (score >= 0) keep(best, &nseed, max, at, score);
+        }
+        if (nseed == max) {
+            floor = best[max - 1].score;
+            floor_end = longer_from(best[max - 1].at);
+        }
+    }
+    for (int i = 0; i < nparts; i++) {
+        Part *p = &parts[i];
+        p->qy = &qy;
+        p->block_top = block_top;
+        p->rest_top = rest_top;
+        p->subset = subset;
+        p->from = (uint32_t)((uint64_t)ncand * (uint64_t)i / (uint64_t)nparts);
+        p->to = (uint32_t)((uint64_t)ncand * (uint64_t)(i + 1) / (uint64_t)nparts);
+        p->best = best + (size_t)max * (size_t)(i + 1);
+        p->nbest = 0;
+        p->floor = floor;
+        p->floor_end = floor_end;
+        p->max = max;
+        p->hits = hits + p->from;
+        p->nhits = 0;
+    }
+    Task *tasks[FINDER_MAX_PARTS];
+    int ntasks = 0;
+    for (int i = 1; i < nparts; i++) {
+        tasks[i] = task_submit(score_part, &parts[i], TASK_PRIORITY_HIGH, NULL);
+        if (tasks[i]) ntasks = i;
+        else score_part(&parts[i]);     /* No threads */
+    }
+    score_part(&parts[0]);
+    for (int i = 1; i <= ntasks; i++)
+        if (tasks[i]) task_wait(tasks[i]);
+
+    /* The parts' best, and their hits joined in order */
+    int n = 0;
+    uint32_t nhits = 0;
+    for (int i = 0; i < nparts; i++) {
+        for (int k = 0; k < parts[i].nbest; k++)
+            keep(best, &n, max, parts[i].best[k].at, parts[i].best[k].score);
+        memmove(hits + nhits, parts[i].hits, sizeof(*hits) * parts[i].nhits);
+        nhits += parts[i].nhits;
+    }
+    n = score_later(&qy, parts, nparts, hits, &nhits, best, n, max, floor, floor_end);
+    for (int i = 0; i < nparts; i++) {
+        free(parts[i].later);
+        free(parts[i].later_top);
+    }
+    for (int i = 0; i < n; i++) {
+        const Entry *e = &fnd.list.e[best[i].at];
+        out[i].path = e->path;
+        out[i].len = (int)e->len;
+        out[i].score = best[i].score;
+    }
+    free(block_top);
+
+    if (qlen > 0) {
+        free(fnd.hits);
+        fnd.hits = hits;
+        fnd.nhits = nhits;
+        fnd.shown = xrealloc(fnd.shown, sizeof(*fnd.shown) * (size_t)(n ? n : 1));
+        for (int i = 0; i < n; i++) fnd.shown[i] = best[i].at;
+        fnd.nshown = n;
+        fnd.hits_gen = fnd.gen;
+        fnd.have_hits = 1;
+        memcpy(fnd.last, q, qlen + 1);
+        fnd.last_len = qlen;
+    } else {
+        free(hits);
+    }
+    free(best);
+    return n;
+}
+
+long finder_count(void) {
+    return (long)fnd.list.n;
+}
+
+int finder_busy(void) {
+    return fnd.job != NULL;
+}
+
+void finder_wait(void) {
+    while (fnd.root && (fnd.job || fnd.nmarked > 0 || fnd.walk_wanted)) {
+        if (fnd.job) finish_walk();
+        fnd.marked_at = 0;
+        start_next(UINT64_MAX / 2);
+    }
+}
+
+int finder_tick(uint64_t now) {
+    if (fnd.root == NULL) return -1;
+    start_next(now);
+    if (fnd.job || fnd.nmarked == 0) return -1;
+    uint64_t due = fnd.marked_at + (uint64_t)FINDER_SETTLE_MS * 1000000;
+    return due > now ? (int)((due - now + 999999) / 1000000) : 0;
+}
@@ -0,0 +1,98 @@
+/* finder.h - Fuzzy file finder over the project's files (:find)
+ *
+ * The finder keeps the paths of the files under the project root (those
+ * .gitignore does not hide) in memory, each with a mask of the characters
+ * in it, and caches them in .loki/files under the root so that the next
+ * session has them at once. A walk on the task pool brings the list up to
+ * date when the finder opens and on finder_refresh() (:find!); between
+ * walks the root's watcher (uv_fs_event_t; recursive where the platform
+ * allows, the root's own entries otherwise) and saved buffers
+ * (finder_note_file()) mark paths, which are looked at again once no mark
+ * came for FINDER_SETTLE_MS: a file there is added, a path gone is
+ * dropped with what was under it. More than FINDER_MARKS_WALK marks at
+ * once, or a new directory, walk the tree again instead.
+ *
+ * A query is matched as a subsequence of the path, case folded, and
+ * scored by the characters running on from each other, starting a part of
+ * the path (after '/', '_', '-', '.', or a lower case letter before an
+ * upper case one) and falling in the file name. The list is kept
+ * shortest first, with a sketch of each path (the characters in its file
+ * name and at the start of its parts, and the pairs of characters next to
+ * each other) that bounds the score it can get. A path is only scored if
+ * its mask holds the query's characters and its bound can still beat the
+ * worst of those kept; paths whose bound is below the best seen so far are
+ * put off and scored last, highest bound first. The best paths of the last
+ * query seed what is kept, and the paths matching it are kept, so that
+ * while the query is typed on each key only looks at those. Lists of more
+ * than FINDER_PART_PATHS paths are scored in parts on the task pool.
+ */
+
+#ifndef LOKI_FINDER_H
+#define LOKI_FINDER_H
+
+#include <stdint.h>
+#include "async_queue.h"
+
+/* Async event telling that a walk is done */
+#define FINDER_ASYNC_EVENT (ASYNC_EVENT_USER + 10)
+
+/* Marked paths are looked at this long after the last mark */
+#define FINDER_SETTLE_MS 100
+
+/* More marks than this at once walk the tree instead */
+#define FINDER_MARKS_WALK 64
+
+/* Paths scored per task, at least */
+#define FINDER_PART_PATHS 32768
+
+/* Longest query; longer ones are cut */
+#define FINDER_MAX_QUERY 255
+
+/* A path found. Not NUL-terminated, and valid until the main loop runs
+ * again. */
+typedef struct FinderMatch {
+    const char *path;       /* Relative to the root */
+    int len;
+    int score;
+} FinderMatch;
+
+/* Use the file list of the project at 'root' (the cached one if there is
+ * one), start a walk to bring it up to date, and watch the root.
+ * Reopening another root closes the first. Returns 0, or -1 if the root
+ * can't be resolved. */
+int finder_open(const char *root);
+
+/* Whether the finder is open, and its root as given */
+const char *finder_root(void);
+
+/* Cache the list if it changed, stop the watch and free the list. */
+void finder_close(void);
+
+/* Walk the tree again. A walk already running is followed by another.
+ * Returns 0, or -1 if the finder is not open. */
+int finder_refresh(void);
+
+/* The file at 'path' (relative to the current directory, or absolute)
+ * was written or deleted: look at it again, if it is under the root. */
+void finder_note_file(const char *path);
+
+/* The 'max' paths best matching 'query', best first, go to 'out' (an
+ * empty query matches every path, shortest first). Returns the number
+ * found (at most 'max'), or -1 if the finder is not open. */
+int finder_find(const char *query, FinderMatch *out, int max);
+
+/* Paths in the list */
+long finder_count(void);
+
+/* Whether a walk is running */
+int finder_busy(void);
+
+/* Wait for the walk running or due, and the marks, and take them in.
+ * For tests. */
+void finder_wait(void);
+
+/* Look at the marked paths if they are due at 'now' (uv_hrtime()).
+ * Returns the milliseconds until they are, or -1 if none are marked. */
+int finder_tick(uint64_t now);
+
+#endif /* LOKI_FINDER_H */
@@ -0,0 +1,400 @@
+/* fold.c - Code folding
+ *
+ * See fold.h for an overview. The folds are an array sorted by head, the
+ * enclosing fold before those inside it. The closed ones that are shown
+ * (not inside another closed fold) give the hidden ranges, rebuilt from
+ * the array whenever it changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+#include "internal.h"
+#ifdef LOKI_USE_LINENOISE
+#include "treesitter.h"
+#endif
+
+typedef struct {
+    int first, last;
+    int closed;
+} Fold;
+
+struct FoldSet {
+    Fold *fold;
+    int count, cap;
+    int *hfirst, *hlast;    /* Hidden ranges [hfirst, hlast], in order */
+    int *hbefore;           /* Rows hidden before range i; [nh]: all */
+    int nh, hcap;
+    int dirty;              /* Ranges out of date */
+    unsigned long gen;
+};
+
+FoldSet *fold_set_new(void) {
+    FoldSet *set = calloc(1, sizeof(*set));
+    if (set) set->gen = 1;
+    return set;
+}
+
+void fold_set_free(FoldSet *set) {
+    if (!set) return;
+    free(set->fold);
+    free(set->hfirst);
+    free(set->hlast);
+    free(set->hbefore);
+    free(set);
+}
+
+static void changed(FoldSet *set) {
+    set->dirty = 1;
+    set->gen++;
+}
+
+static int fold_cmp(const void *a, const void *b) {
+    const Fold *x = a, *y = b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return (x->last < y->last) - (x->last > y->last);   /* Outer first */
+}
+
+static int reserve(FoldSet *set, int count) {
+    if (count <= set->cap) return 0;
+    int cap = set->cap ? set->cap : 16;
+    while (cap < count) cap *= 2;
+    Fold *fold = realloc(set->fold, sizeof(*fold) * (size_t)cap);
+    if (!fold) return -1;
+    set->fold = fold;
+    set->cap = cap;
+    return 0;
+}
+
+/* Sort the folds, and drop those that cover one row or share the head of
+ * an enclosing fold, clipping those that cross out of one */
+static void normalize(FoldSet *set) {
+    qsort(set->fold, (size_t)set->count, sizeof(Fold), fold_cmp);
+    int *stack = malloc(sizeof(int) * (size_t)(set->count + 1));
+    if (!stack) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int depth = 0, n = 0;
+    for (int i = 0; i < set->count; i++) {
+        Fold f = set->fold[i];
+        while (depth > 0 && set->fold[stack[depth - 1]].last < f.first) depth--;
+        if (depth > 0) {
+            const Fold *outer = &set->fold[stack[depth - 1]];
+            if (outer->first == f.first) continue;
+            if (f.last > outer->last) f.last = outer->last;
+        }
+        if (f.last <= f.first) continue;
+        set->fold[n] = f;
+        stack[depth++] = n++;
+    }
+    free(stack);
+    set->count = n;
+    changed(set);
+}
+
+int fold_add(FoldSet *set, int first, int last, int closed) {
+    if (first < 0 || last <= first) return -1;
+    int at = set->count;
+    for (int i = 0; i < set->count; i++) {
+        const Fold *f = &set->fold[i];
+        if (f->first == first) return -1;
+        if ((f->first < first && first <= f->last && f->last < last) ||
+            (first < f->first && f->first <= last && last < f->last))
+            return -1;
+        if (at == set->count && f->first > first) at = i;
+    }
+    if (reserve(set, set->count + 1) != 0) return -1;
+    memmove(set->fold + at + 1, set->fold + at,
+            sizeof(Fold) * (size_t)(set->count - at));
+    set->fold[at] = (Fold){ first, last, closed != 0 };
+    set->count++;
+    changed(set);
+    return 0;
+}
+
+int fold_count(const FoldSet *set) {
+    return set ? set->count : 0;
+}
+
+int fold_get(const FoldSet *set, int i, int *first, int *last, int *closed) {
+    if (!set || i < 0 || i >= set->count) return -1;
+    *first = set->fold[i].first;
+    *last = set->fold[i].last;
+    *closed = set->fold[i].closed;
+    return 0;
+}
+
+unsigned long fold_gen(const FoldSet *set) {
+    return set ? set->gen : 0;
+}
+
+/* Rebuild the hidden ranges if the folds changed */
+static void index_folds(FoldSet *set) {
+    if (!set->dirty) return;
+    set->dirty = 0;
+    if (set->count + 1 > set->hcap) {
+        int cap = set->count + 1;
+        int *hfirst = realloc(set->hfirst, sizeof(int) * (size_t)cap);
+        if (hfirst) set->hfirst = hfirst;
+        int *hlast = realloc(set->hlast, sizeof(int) * (size_t)cap);
+        if (hlast) set->hlast = hlast;
+        int *hbefore = realloc(set->hbefore, sizeof(int) * (size_t)cap);
+        if (hbefore) set->hbefore = hbefore;
+        if (!hfirst || !hlast || !hbefore) {
+            perror("Out of memory");
+            exit(1);
+        }
+        set->hcap = cap;
+    }
+
+    int nh = 0, hidden = 0, cover = -1;
+    for (int i = 0; i < set->count; i++) {
+        const Fold *f = &set->fold[i];
+        if (!f->closed || f->first <= cover) continue;
+        set->hfirst[nh] = f->first + 1;
+        set->hlast[nh] = f->last;
+        set->hbefore[nh] = hidden;
+        hidden += f->last - f->first;
+        cover = f->last;
+        nh++;
+    }
+    set->hbefore[nh] = hidden;
+    set->nh = nh;
+}
+
+int fold_hidden(FoldSet *set) {
+    if (!set) return 0;
+    index_folds(set);
+    return set->hbefore[set->nh];
+}
+
+/* Index of the last hidden range starting at or before 'row', or -1 */
+static int range_at(FoldSet *set, int row) {
+    index_folds(set);
+    int lo = 0, hi = set->nh;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (set->hfirst[mid] <= row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+int fold_head(FoldSet *set, int row) {
+    if (!set) return row;
+    int i = range_at(set, row);
+    return i >= 0 && row <= set->hlast[i] ? set->hfirst[i] - 1 : row;
+}
+
+int fold_next(FoldSet *set, int row) {
+    if (!set) return row + 1;
+    int i = range_at(set, row + 1);
+    return i >= 0 && row + 1 <= set->hlast[i] ? set->hlast[i] + 1 : row + 1;
+}
+
+int fold_prev(FoldSet *set, int row) {
+    return row > 0 ? fold_head(set, row - 1) : 0;
+}
+
+int fold_screen_row(FoldSet *set, int row) {
+    if (!set) return row;
+    int i = range_at(set, row);
+    if (i < 0) return row;
+    if (row <= set->hlast[i]) return set->hfirst[i] - 1 - set->hbefore[i];
+    return row - set->hbefore[i + 1];
+}
+
+int fold_row(FoldSet *set, int screen_row) {
+    if (!set) return screen_row;
+    index_folds(set);
+    /* Ranges whose head is shown above screen_row come before it */
+    int lo = 0, hi = set->nh;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (set->hfirst[mid] - 1 - set->hbefore[mid] < screen_row) lo = mid + 1;
+        else hi = mid;
+    }
+    return screen_row + set->hbefore[lo];
+}
+
+int fold_closed_last(FoldSet *set, int row) {
+    if (!set) return -1;
+    int i = range_at(set, row + 1);
+    return i >= 0 && set->hfirst[i] == row + 1 ? set->hlast[i] : -1;
+}
+
+int fold_open(FoldSet *set, int row) {
+    if (!set) return 0;
+    for (int i = 0; i < set->count && set->fold[i].first <= row; i++) {
+        Fold *f = &set->fold[i];
+        if (f->closed && row <= f->last) {
+            f->closed = 0;
+            changed(set);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int fold_close(FoldSet *set, int row) {
+    if (!set) return 0;
+    int inner = -1;
+    for (int i = 0; i < set->count && set->fold[i].first <= row; i++)
+        if (row <= set->fold[i].last && !set->fold[i].closed) inner = i;
+    if (inner < 0) return 0;
+    set->fold[inner].closed = 1;
+    changed(set);
+    return 1;
+}
+
+int fold_toggle(FoldSet *set, int row) {
+    return fold_open(set, row) || fold_close(set, row);
+}
+
+void fold_set_all(FoldSet *set, int closed) {
+    if (!set) return;
+    for (int i = 0; i < set->count; i++) set->fold[i].closed = closed != 0;
+    changed(set);
+}
+
+void fold_clear(FoldSet *set) {
+    if (!set) return;
+    set->count = 0;
+    changed(set);
+}
+
+/* The edit being applied, for the rows it moves */
+typedef struct {
+    int srow, scol, orow, ocol, nrow, ncol;
+} FoldEdit;
+
+/* Where the start of row 'row' goes. A row starting where text is
+ * inserted goes after it with 'after'; one starting inside replaced
+ * text goes to the edit's row. */
+static int move_row(const FoldEdit *e, int row, int after) {
+    if (row < e->srow || (row == e->srow && e->scol > 0)) return row;
+    if (e->srow == e->orow && e->scol == e->ocol)
+        return row == e->srow ? (after ? e->nrow : row) : row + e->nrow - e->orow;
+    if (row < e->orow || (row == e->orow && e->ocol > 0)) return e->srow;
+    return row + e->nrow - e->orow;
+}
+
+void fold_note_edit(FoldSet *set, int start_row, int start_col,
+                    int old_end_row, int old_end_col,
+                    int new_end_row, int new_end_col) {
+    if (!set || set->count == 0) return;
+    FoldEdit e = { start_row, start_col, old_end_row, old_end_col,
+                   new_end_row, new_end_col };
+    if (e.orow == e.nrow && e.srow == e.orow) return;  /* Within a row */
+
+    int moved = 0, dropped = 0;
+    for (int i = 0; i < set->count; i++) {
+        Fold *f = &set->fold[i];
+        if (f->last < start_row) continue;
+        int first = move_row(&e, f->first, 1);
+        int last = move_row(&e, f->last + 1, 0) - 1;
+        if (first != f->first || last != f->last) moved = 1;
+        if (last <= first) dropped = 1;
+        f->first = first;
+        f->last = last;
+    }
+    if (dropped || moved) normalize(set);
+}
+
+int fold_from_indent(editor_ctx_t *ctx) {
+    EditorModel *model = &ctx->model;
+    if (!model->folds && !(model->folds = fold_set_new())) return 0;
+    FoldSet *set = model->folds;
+    set->count = 0;
+
+    /* Rows of the blocks still open, and their indentation */
+    int *head = malloc(sizeof(int) * (size_t)(model->numrows + 1));
+    int *level = malloc(sizeof(int) * (size_t)(model->numrows + 1));
+    if (!head || !level) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int depth = 0, last_text = -1;
+    for (int r = 0; r <= model->numrows; r++) {
+        int indent = -1;
+        if (r < model->numrows) {
+            const t_erow *row = &model->row[r];
+            int col = 0, j = 0;
+            for (; j < row->size; j++) {
+                if (row->chars[j] == ' ') col++;
+                else if (row->chars[j] == '\t') col = (col / 8 + 1) * 8;
+                else break;
+            }
+            if (j == row->size) continue;   /* Blank: part of the block */
+            indent = col;
+        }
+        while (depth > 0 && level[depth - 1] >= indent) {
+            int first = head[--depth];
+            if (last_text > first) {
+                if (reserve(set, set->count + 1) != 0) {
+                    perror("Out of memory");
+                    exit(1);
+                }
+                set->fold[set->count++] = (Fold){ first, last_text, 1 };
+            }
+        }
+        if (r < model->numrows) {
+            head[depth] = r;
+            level[depth++] = indent;
+            last_text = r;
+        }
+    }
+    free(head);
+    free(level);
+    normalize(set);
+    return set->count;
+}
+
+#ifdef LOKI_USE_LINENOISE
+static void add_syntax_fold(void *opaque, int first, int last) {
+    FoldSet *set = opaque;
+    if (last <= first) return;
+    if (reserve(set, set->count + 1) != 0) {
+        perror("Out of memory");
+        exit(1);
+    }
+    set->fold[set->count++] = (Fold){ first, last, 1 };
+}
+#endif
+
+int fold_from_syntax(editor_ctx_t *ctx) {
+#ifdef LOKI_USE_LINENOISE
+    EditorModel *model = &ctx->model;
+    if (!model->ts_state || !model->ts_state->tree) return -1;
+    if (!model->folds && !(model->folds = fold_set_new())) return 0;
+    model->folds->count = 0;
+    treesitter_fold_ranges(model->ts_state, add_syntax_fold, model->folds);
+    normalize(model->folds);
+    return model->folds->count;
+#else
+    (void)ctx;
+    return -1;
+#endif
+}
+
+int fold_syntax_at(editor_ctx_t *ctx, int row) {
+#ifdef LOKI_USE_LINENOISE
+    EditorModel *model = &ctx->model;
+    int first, last;
+    if (!model->ts_state || !model->ts_state->tree) return -2;
+    if (!treesitter_fold_at(model->ts_state, row, &first, &last)) return -1;
+    if (!model->folds && !(model->folds = fold_set_new())) return -1;
+    if (last >= model->numrows) last = model->numrows - 1;
+    if (fold_add(model->folds, first, last, 1) != 0 &&
+        !fold_close(model->folds, first))
+        return -1;
+    return first;
+#else
+    (void)ctx;
+    (void)row;
+    return -2;
+#endif
+}
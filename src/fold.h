@@ -0,0 +1,102 @@
+/* fold.h - Code folding
+ *
+ * A fold covers rows [first, last] of a buffer. Closed, it shows as its
+ * first row (the head) and hides the others; folds nest, and may not
+ * cross. They are made by hand (zf, :fold), from indentation
+ * (:foldindent) or from the syntax tree (:foldsyntax, or zf on the node
+ * at the cursor), and opened and
+ * closed with zo, zc, za, zR and zM.
+ *
+ * The shown rows are what the screen, scrolling and cursor motion walk:
+ * the closed folds are kept as sorted ranges of hidden rows with the
+ * number hidden before each, so mapping a file row to its screen row and
+ * back, or finding the next shown row, is a binary search, O(log folds),
+ * and a hidden row is never segmented or drawn. A million-line file
+ * folded to its top level is walked as its few thousand heads.
+ *
+ * Edits move the folds with their rows (fold_note_edit()), a pass over
+ * the folds; the ranges are rebuilt on the next lookup after a change.
+ */
+
+#ifndef LOKI_FOLD_H
+#define LOKI_FOLD_H
+
+struct editor_ctx;
+
+typedef struct FoldSet FoldSet;
+
+/* Create an empty set. Returns NULL on out of memory. */
+FoldSet *fold_set_new(void);
+
+/* Release a set. Safe on NULL. */
+void fold_set_free(FoldSet *set);
+
+/* Add a fold over rows [first, last]. Returns 0, or -1 if it covers one
+ * row, crosses a fold, has the same head as one, or memory runs out. */
+int fold_add(FoldSet *set, int first, int last, int closed);
+
+/* Folds in the set, and rows they hide. */
+int fold_count(const FoldSet *set);
+int fold_hidden(FoldSet *set);
+
+/* Fold 'i' of the set, in order of their heads (enclosing folds first).
+ * Returns 0, or -1 if there is no such fold. */
+int fold_get(const FoldSet *set, int i, int *first, int *last, int *closed);
+
+/* Bumped by every change to what the folds show. */
+unsigned long fold_gen(const FoldSet *set);
+
+/* Open the outermost closed fold holding 'row' (zo), close the innermost
+ * open one (zc), or whichever of the two applies (za). Return 1 if a fold
+ * changed. */
+int fold_open(FoldSet *set, int row);
+int fold_close(FoldSet *set, int row);
+int fold_toggle(FoldSet *set, int row);
+
+/* Open (zR) or close (zM) every fold. */
+void fold_set_all(FoldSet *set, int closed);
+
+/* Remove every fold (zE). */
+void fold_clear(FoldSet *set);
+
+/* The row shown for 'row': itself, or the head of the closed fold
+ * hiding it. Every lookup takes a NULL set as one without folds. */
+int fold_head(FoldSet *set, int row);
+
+/* The shown row after shown row 'row' (past the fold it heads, if
+ * closed), and the one before it. */
+int fold_next(FoldSet *set, int row);
+int fold_prev(FoldSet *set, int row);
+
+/* Screen row of shown row 'row' with no scrolling: the rows shown above
+ * it. fold_row() is the inverse. */
+int fold_screen_row(FoldSet *set, int row);
+int fold_row(FoldSet *set, int screen_row);
+
+/* If 'row' heads a closed fold that is shown, its last row; else -1. */
+int fold_closed_last(FoldSet *set, int row);
+
+/* The text from (start_row, start_col) up to (old_end_row, old_end_col)
+ * was replaced by text ending at (new_end_row, new_end_col). Folds move
+ * with their rows; a fold left covering one row is dropped. */
+void fold_note_edit(FoldSet *set, int start_row, int start_col,
+                    int old_end_row, int old_end_col,
+                    int new_end_row, int new_end_col);
+
+/* Replace the buffer's folds with a fold per indented block: the rows
+ * after a line that are indented deeper than it, blank lines between
+ * them included. Every fold is closed. Returns the folds made. */
+int fold_from_indent(struct editor_ctx *ctx);
+
+/* The same from the syntax tree: a fold per node over several rows (the
+ * language's fold query picks the nodes, if it has one). Returns the
+ * folds made, or -1 if the buffer has no tree. */
+int fold_from_syntax(struct editor_ctx *ctx);
+
+/* Fold the innermost syntax node over several rows around 'row', closed
+ * (zf without a selection), looking at the nodes over 'row' only; a fold
+ * with its head already there is closed. Returns the fold's first row,
+ * -1 if there is no such node, or -2 if the buffer has no tree. */
+int fold_syntax_at(struct editor_ctx *ctx, int row);
+
+#endif /* LOKI_FOLD_H */
@@ -0,0 +1,301 @@
+/* follow.c - Following a file as it grows, like tail -f
+ *
+ * See follow.h for an overview. The file stays open: each read is a
+ * pread() from the offset read up to, and a replacement is noticed by
+ * its path naming another inode.
+ */
+
+#define _DEFAULT_SOURCE     /* pread() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "follow.h"
+#include "event_loop.h"
+#include "loader.h"
+#include "multicursor.h"
+#include "reload.h"
+#include "undo.h"
+
+struct FollowFile {
+    uv_fs_event_t event;    /* Its data is the FollowFile */
+    int handle;             /* 'event' is initialized */
+    int watching;           /* 'event' is started: no polling */
+    int moved;              /* The file was renamed or deleted */
+    int changed;            /* An event came since the last read */
+    int more;               /* The last read left bytes for the next */
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;           /* Bytes read */
+    int partial;            /* The last row is a line not ended yet */
+    int max_rows;           /* 0: no cap */
+    uint64_t checked;       /* When last read (uv_hrtime()) */
+};
+
+static void on_event(uv_fs_event_t *handle, const char *name, int events,
+                     int status) {
+    (void)name;
+    (void)status;
+    FollowFile *ff = handle->data;
+    ff->changed = 1;
+    if (events & UV_RENAME) ff->moved = 1;
+}
+
+static void on_close(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+/* Watch the file at 'path', or leave it to be polled */
+static void watch(FollowFile *ff, const char *path) {
+    if (ff->watching) uv_fs_event_stop(&ff->event);
+    ff->watching = ff->handle &&
+                   uv_fs_event_start(&ff->event, on_event, path, 0) == 0;
+    ff->moved = 0;
+}
+
+/* Take over 'fd', the file at its start */
+static void set_file(FollowFile *ff, int fd, const struct stat *st) {
+    ff->fd = fd;
+    ff->dev = st->st_dev;
+    ff->ino = st->st_ino;
+}
+
+/* Drop the oldest rows over the cap once they are more than 'slack',
+ * keeping the cursor on its line */
+static void trim(editor_ctx_t *ctx, int slack) {
+    FollowFile *ff = ctx->model.follow;
+    int over = ctx->model.numrows - ff->max_rows;
+    if (ff->max_rows == 0 || over <= slack) return;
+
+    int row = ctx->view.rowoff + ctx->view.cy - over;
+    int rowoff = ctx->view.rowoff - over;
+    editor_del_rows(ctx, 0, over);
+    if (row < 0) row = 0;
+    if (rowoff < 0) rowoff = 0;
+    if (rowoff > row) rowoff = row;
+    ctx->view.rowoff = rowoff;
+    ctx->view.cy = row - rowoff;
+    ctx->view.sel_active = 0;
+    multicursor_clear(ctx);
+}
+
+void follow_append(editor_ctx_t *ctx, char *buf, size_t n, int *partial) {
+    EditorModel *model = &ctx->model;
+    int at_end = ctx->view.rowoff + ctx->view.cy >= model->numrows - 1;
+
+    /* The rest of a line shown before it ended */
+    size_t from = 0;
+    if (*partial && model->numrows > 0) {
+        char *nl = memchr(buf, '\n', n);
+        size_t len = nl ? (size_t)(nl - buf) : n;
+        from = nl ? len + 1 : n;
+        while (len > 0 && buf[len - 1] == '\r') len--;
+        editor_row_append_string(ctx, &model->row[model->numrows - 1], buf, len);
+    }
+
+    if (from < n) {
+        LineIndex index;
+        if (loader_index_lines(buf + from, n - from, &index) == -1) {
+            editor_set_status_msg(ctx, "Cannot add lines: %s", strerror(errno));
+        } else if (index.binary) {
+            editor_set_status_msg(ctx, "Binary data added: not shown");
+        } else {
+            LoadedFile chunk = {buf + from, n - from, 0, 0};
+            editor_append_lines(ctx, &chunk, &index);
+        }
+        loader_index_free(&index);
+    }
+    *partial = buf[n - 1] != '\n';
+    if (at_end && model->numrows > 0) editor_cursor_to(ctx, model->numrows - 1, 0);
+}
+
+/* Add the rows of buf[0..n), the file's bytes from the offset read up to */
+static void append(editor_ctx_t *ctx, char *buf, size_t n) {
+    FollowFile *ff = ctx->model.follow;
+    follow_append(ctx, buf, n, &ff->partial);
+    trim(ctx, ff->max_rows / 8);
+    ctx->model.dirty = 0;
+}
+
+/* Read up to FOLLOW_READ_MAX bytes from the offset. Returns the rows
+ * added, or -1 on an error. */
+static int read_new(editor_ctx_t *ctx) {
+    FollowFile *ff = ctx->model.follow;
+    struct stat st;
+    if (fstat(ff->fd, &st) == -1) {
+        editor_set_status_msg(ctx, "Cannot follow %s: %s", ctx->model.filename,
+                              strerror(errno));
+        return -1;
+    }
+    if (st.st_size < ff->offset) {
+        ff->offset = 0;
+        ff->partial = 0;
+        editor_set_status_msg(ctx, "File truncated: following it from its start");
+    }
+    ff->more = 0;
+    if (st.st_size == ff->offset) return 0;
+
+    size_t n = (size_t)(st.st_size - ff->offset);
+    if (n > FOLLOW_READ_MAX) {
+        n = FOLLOW_READ_MAX;
+        ff->more = 1;
+    }
+    char *buf = malloc(n);
+    if (buf == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(ff->fd, buf + got, n - got, ff->offset + (off_t)got);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            editor_set_status_msg(ctx, "Cannot read %s: %s", ctx->model.filename,
+                                  strerror(errno));
+            free(buf);
+            return -1;
+        }
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+
+    int before = ctx->model.numrows;
+    if (got > 0) append(ctx, buf, got);
+    ff->offset += (off_t)got;
+    free(buf);
+    return ctx->model.numrows - before;
+}
+
+/* Is another file at the path now? Then follow it instead. */
+static int reopen_if_replaced(editor_ctx_t *ctx) {
+    FollowFile *ff = ctx->model.follow;
+    struct stat st;
+    if (stat(ctx->model.filename, &st) == -1) return 0;    /* Not yet */
+    if (st.st_dev == ff->dev && st.st_ino == ff->ino) {
+        if (ff->moved) watch(ff, ctx->model.filename);      /* Moved back */
+        return 0;
+    }
+    int fd = open(ctx->model.filename, O_RDONLY);
+    if (fd == -1) return 0;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+    close(ff->fd);
+    set_file(ff, fd, &st);
+    ff->offset = 0;
+    ff->partial = 0;
+    watch(ff, ctx->model.filename);
+    editor_set_status_msg(ctx, "File replaced: following the new one");
+    return 1;
+}
+
+int follow_start(editor_ctx_t *ctx, int max_rows) {
+    EditorModel *model = &ctx->model;
+    if (max_rows < 0) max_rows = 0;
+    if (model->follow) {
+        model->follow->max_rows = max_rows;
+        trim(ctx, 0);
+        return 0;
+    }
+    if (model->filename == NULL) {
+        editor_set_status_msg(ctx, "No file to follow");
+        return -1;
+    }
+    if (model->lazy) {
+        editor_set_status_msg(ctx, "Cannot follow a file this large");
+        return -1;
+    }
+    if (model->dirty) {
+        editor_set_status_msg(ctx, "Unsaved changes: save or reload the file first");
+        return -1;
+    }
+
+    struct stat st;
+    int fd = open(model->filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        editor_set_status_msg(ctx, "Cannot follow %s: %s", model->filename,
+                              strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    FollowFile *ff = calloc(1, sizeof(FollowFile));
+    if (ff == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    set_file(ff, fd, &st);
+    ff->offset = st.st_size;
+    ff->max_rows = max_rows;
+    ff->checked = uv_hrtime();
+
+    /* A last line without a newline is still being written */
+    char last = '\n';
+    if (st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) != 1) last = '\n';
+    ff->partial = model->numrows > 0 && (st.st_size == 0 || last != '\n');
+
+    ff->handle = uv_fs_event_init(uv_default_loop(), &ff->event) == 0;
+    ff->event.data = ff;
+    watch(ff, model->filename);
+    model->follow = ff;
+    reload_unwatch(model);   /* Changes are read as they come instead */
+
+    /* The rows are going to move under the history */
+    undo_history_detach(ctx);
+    trim(ctx, 0);
+    if (model->numrows > 0) editor_cursor_to(ctx, model->numrows - 1, 0);
+    editor_set_status_msg(ctx, "Following %s", model->filename);
+    return 0;
+}
+
+void follow_stop(EditorModel *model) {
+    FollowFile *ff = model->follow;
+    if (ff == NULL) return;
+    model->follow = NULL;
+    close(ff->fd);
+    /* Freed once the loop has closed the handle */
+    if (ff->handle) uv_close((uv_handle_t *)&ff->event, on_close);
+    else free(ff);
+}
+
+int follow_read(editor_ctx_t *ctx) {
+    FollowFile *ff = ctx->model.follow;
+    if (ff == NULL) return 0;
+    ff->changed = 0;
+
+    /* What was written to the old file, then the new one */
+    int rows = read_new(ctx);
+    if (rows == -1 || ff->more) return rows;
+    if (reopen_if_replaced(ctx)) {
+        int added = read_new(ctx);
+        if (added == -1) return -1;
+        rows += added;
+    }
+    return rows;
+}
+
+int follow_tick(editor_ctx_t *ctx, uint64_t now) {
+    FollowFile *ff = ctx->model.follow;
+    if (ff == NULL) return -1;
+
+    /* Polled without events, or until a file moved away is back */
+    int polled = !ff->watching || ff->moved || !event_loop_active();
+    uint64_t due = ff->checked + (uint64_t)FOLLOW_POLL_MS * 1000000;
+    if (ff->changed || ff->more || (polled && now >= due)) {
+        ff->checked = now;
+        follow_read(ctx);
+        polled = !ff->watching || ff->moved || !event_loop_active();
+        due = now + (uint64_t)FOLLOW_POLL_MS * 1000000;
+    }
+    if (ff->more) return 0;
+    if (!polled) return -1;
+    return now >= due ? 0 : (int)((due - now) / 1000000) + 1;
+}
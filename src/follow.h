@@ -0,0 +1,62 @@
+/* follow.h - Following a file as it grows, like tail -f
+ *
+ * follow_start() watches the buffer's file with a uv_fs_event_t (inotify,
+ * kqueue, ...) on the loop event_loop_wait() sleeps in. An event only sets
+ * a flag: follow_tick(), run by the main loop, then reads the bytes past
+ * the offset read up to, indexes them with loader_index_lines() and adds
+ * their rows with one editor_append_lines(). The rows already shown are
+ * not read or highlighted again, and the file is never reopened for a
+ * change. A line written in parts is completed on the row it started.
+ *
+ * While the cursor is on the last row the view keeps to the end as rows
+ * come in; moving up holds it where it is.
+ *
+ * With a row cap, once the buffer holds an eighth more rows than the cap
+ * the oldest are dropped with one editor_del_rows(), so each appended row
+ * costs the same however long the file has been followed.
+ *
+ * A file truncated in place, or replaced at its path (rotated), is read
+ * from its start again after the rows already shown. Where file events
+ * are not available the file is checked every FOLLOW_POLL_MS. A followed
+ * buffer is read-only (see editor_refuse_edit()).
+ */
+
+#ifndef LOKI_FOLLOW_H
+#define LOKI_FOLLOW_H
+
+#include <stdint.h>
+#include "internal.h"
+
+/* Milliseconds between checks of a file without file events */
+#define FOLLOW_POLL_MS 250
+
+/* Bytes read per tick at most: a burst is shown over several frames */
+#define FOLLOW_READ_MAX ((size_t)16 << 20)
+
+typedef struct FollowFile FollowFile;
+
+/* Follow the buffer's file, keeping at most 'max_rows' rows (0: all).
+ * Following already, only sets the cap. Returns 0, or -1 with the reason
+ * in the status. */
+int follow_start(editor_ctx_t *ctx, int max_rows);
+
+/* Stop following. Safe on a model not followed. */
+void follow_stop(EditorModel *model);
+
+/* Read what has been added to the file since the last read. Returns the
+ * rows added, or -1 on a read error (said in the status). */
+int follow_read(editor_ctx_t *ctx);
+
+/* Add the rows of buf[0..n), n > 0, to the end of the buffer, as a
+ * followed file's are: the first line completes the last row if *partial
+ * (set for the next call), and the view keeps to the end if the cursor
+ * is on the last row. Also for output other than a file's (job.h). */
+void follow_append(editor_ctx_t *ctx, char *buf, size_t n, int *partial);
+
+/* Read the file if it changed, or if a check is due at 'now'
+ * (uv_hrtime()). Returns the milliseconds until the next check is due (0:
+ * more bytes are waiting), or -1 if there is nothing to do until the file
+ * changes. */
+int follow_tick(editor_ctx_t *ctx, uint64_t now);
+
+#endif /* LOKI_FOLLOW_H */
@@ -0,0 +1,68 @@
+/* frame_pacer.c - Render scheduling for the interactive loops
+ *
+ * See frame_pacer.h for an overview.
+ */
+
+#include "frame_pacer.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+static int frame_rate = FRAME_RATE_DEFAULT;
+
+static uint64_t frame_interval(void) {
+    return frame_rate > 0 ? NSEC_PER_SEC / (uint64_t)frame_rate : 0;
+}
+
+void frame_pacer_set_rate(int fps) {
+    if (fps < 0) fps = 0;
+    if (fps > FRAME_RATE_MAX) fps = FRAME_RATE_MAX;
+    frame_rate = fps;
+}
+
+int frame_pacer_get_rate(void) {
+    return frame_rate;
+}
+
+void frame_pacer_init(FramePacer *pacer) {
+    pacer->last_frame = 0;
+    pacer->stamp = 0;
+    pacer->damaged = 1;
+}
+
+void frame_pacer_damage(FramePacer *pacer) {
+    pacer->damaged = 1;
+}
+
+void frame_pacer_note_state(FramePacer *pacer, uint64_t stamp) {
+    if (stamp != pacer->stamp) pacer->damaged = 1;
+}
+
+/* Time at which the next frame may be drawn. */
+static uint64_t next_frame(const FramePacer *pacer) {
+    if (pacer->last_frame == 0) return 0;  /* Nothing drawn yet */
+    return pacer->last_frame + frame_interval();
+}
+
+int frame_pacer_ready(const FramePacer *pacer, uint64_t now) {
+    return pacer->damaged && now >= next_frame(pacer);
+}
+
+void frame_pacer_drawn(FramePacer *pacer, uint64_t now, uint64_t stamp) {
+    pacer->last_frame = now;
+    pacer->stamp = stamp;
+    pacer->damaged = 0;
+}
+
+int frame_pacer_timeout(const FramePacer *pacer, uint64_t now) {
+    if (!pacer->damaged) return -1;
+    uint64_t due = next_frame(pacer);
+    if (now >= due) return 0;
+    /* Round up so the wait never ends just short of the deadline */
+    return (int)((due - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+}
+
+int frame_pacer_within_frame(uint64_t since, uint64_t now) {
+    uint64_t interval = frame_interval();
+    return interval == 0 || now - since < interval;
+}
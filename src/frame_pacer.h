@@ -0,0 +1,61 @@
+/* frame_pacer.h - Render scheduling for the interactive loops
+ *
+ * The main loops drain all pending input and async events before drawing,
+ * then draw at most once per frame interval, and not at all when nothing
+ * on screen can have changed. A FramePacer holds that decision:
+ *
+ *   - frame_pacer_damage() records that something visible may have changed
+ *     (a key was handled, an async event dispatched, the window resized).
+ *   - frame_pacer_note_state() compares a cheap fingerprint of the screen
+ *     state (editor_screen_stamp()) so changes made behind the loop's back,
+ *     e.g. by language callbacks or an expiring status message, still count.
+ *   - frame_pacer_ready() says whether to draw now; frame_pacer_timeout()
+ *     how long the loop may block waiting for input before it must draw.
+ *
+ * Times are uv_hrtime() nanoseconds, passed in so the pacer can be driven
+ * by a fake clock. The frame rate is a process-wide setting (:set fps=N);
+ * 0 draws as soon as anything is damaged.
+ */
+
+#ifndef LOKI_FRAME_PACER_H
+#define LOKI_FRAME_PACER_H
+
+#include <stdint.h>
+
+#define FRAME_RATE_DEFAULT 120    /* Frames per second */
+#define FRAME_RATE_MAX 1000
+
+typedef struct FramePacer {
+    uint64_t last_frame;      /* Time the last frame was drawn */
+    uint64_t stamp;           /* Screen state fingerprint at that frame */
+    int damaged;              /* Something visible changed since */
+} FramePacer;
+
+/* Start with a frame due immediately. */
+void frame_pacer_init(FramePacer *pacer);
+
+/* Mark the screen as needing a redraw. */
+void frame_pacer_damage(FramePacer *pacer);
+
+/* Damage the screen if 'stamp' differs from the last drawn state. */
+void frame_pacer_note_state(FramePacer *pacer, uint64_t stamp);
+
+/* 1 if a frame should be drawn at 'now': damaged and the interval passed. */
+int frame_pacer_ready(const FramePacer *pacer, uint64_t now);
+
+/* Record a frame drawn at 'now' showing state 'stamp'. */
+void frame_pacer_drawn(FramePacer *pacer, uint64_t now, uint64_t stamp);
+
+/* Milliseconds until a pending frame is due (0 if due now), or -1 when
+ * nothing is damaged and the caller may wait as long as it likes. */
+int frame_pacer_timeout(const FramePacer *pacer, uint64_t now);
+
+/* 1 while 'now' is still inside the frame that started at 'since'; input
+ * bursts are drained until then so a paste cannot starve the screen. */
+int frame_pacer_within_frame(uint64_t since, uint64_t now);
+
+/* Process-wide frame rate. Values are clamped to 0..FRAME_RATE_MAX. */
+void frame_pacer_set_rate(int fps);
+int frame_pacer_get_rate(void);
+
+#endif /* LOKI_FRAME_PACER_H */
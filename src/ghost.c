@@ -0,0 +1,167 @@
+/* ghost.c - Inline suggestions shown in the view, not in the buffer
+ *
+ * See ghost.h for an overview. The first line as drawn is built as text
+ * comes in, so an appended token costs its own length, not the ghost's.
+ */
+
+#include "ghost.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Ghost {
+    int row, col;           /* Where it goes */
+    int dirty;              /* model.dirty when shown: stale if it moved */
+    char *text;             /* All of it, as inserted */
+    size_t len, cap;
+    char *shown;            /* Its first line as drawn */
+    int shown_len, shown_cap;
+    int lines;              /* Newlines in the text */
+};
+
+static void *ghost_alloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+void ghost_free(Ghost *g) {
+    if (!g) return;
+    free(g->text);
+    free(g->shown);
+    free(g);
+}
+
+/* Stamp the row the ghost is drawn on, if it is in the buffer */
+static void damage(EditorModel *model, const Ghost *g) {
+    if (g->row >= 0 && g->row < model->numrows)
+        editor_row_damage(model, &model->row[g->row]);
+}
+
+static void shown_push(Ghost *g, char c) {
+    if (g->shown_len == g->shown_cap) {
+        g->shown_cap = g->shown_cap ? g->shown_cap * 2 : 64;
+        g->shown = ghost_alloc(g->shown, (size_t)g->shown_cap);
+    }
+    g->shown[g->shown_len++] = c;
+}
+
+/* Add text to 'g': all of it to the text, its first line to what is shown */
+static void add(Ghost *g, const char *text, size_t len) {
+    if (g->len + len > g->cap) {
+        size_t cap = g->cap ? g->cap : 256;
+        while (cap < g->len + len) cap *= 2;
+        g->text = ghost_alloc(g->text, cap);
+        g->cap = cap;
+    }
+    memcpy(g->text + g->len, text, len);
+    g->len += len;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '\n') {
+            g->lines++;
+        } else if (g->lines > 0) {
+            continue;
+        } else if (c == TAB) {
+            do shown_push(g, ' '); while (g->shown_len % 8 != 0);
+        } else if (c >= 32 && c != 127) {
+            shown_push(g, (char)c);
+        }
+    }
+}
+
+void ghost_show(editor_ctx_t *ctx, int row, int col, const char *text, size_t len) {
+    EditorModel *model = &ctx->model;
+    Ghost *g = model->ghost;
+    if (g == NULL) {
+        g = model->ghost = calloc(1, sizeof(Ghost));
+        if (g == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+    } else {
+        damage(model, g);
+    }
+
+    if (row < 0) row = 0;
+    if (row > model->numrows) row = model->numrows;
+    int size = row < model->numrows ? model->row[row].size : 0;
+    if (col < 0) col = 0;
+    if (col > size) col = size;
+    g->row = row;
+    g->col = col;
+    g->dirty = model->dirty;
+    g->len = 0;
+    g->shown_len = 0;
+    g->lines = 0;
+    add(g, text, len);
+    damage(model, g);
+}
+
+void ghost_append(editor_ctx_t *ctx, const char *text, size_t len) {
+    if (!ghost_active(ctx)) {
+        ghost_show(ctx, ctx->view.rowoff + ctx->view.cy,
+                   ctx->view.coloff + ctx->view.cx, text, len);
+        return;
+    }
+    add(ctx->model.ghost, text, len);
+    damage(&ctx->model, ctx->model.ghost);
+}
+
+void ghost_clear(editor_ctx_t *ctx) {
+    Ghost *g = ctx->model.ghost;
+    if (g == NULL) return;
+    damage(&ctx->model, g);
+    ghost_free(g);
+    ctx->model.ghost = NULL;
+}
+
+int ghost_active(const editor_ctx_t *ctx) {
+    const Ghost *g = ctx->model.ghost;
+    return g != NULL && g->dirty == ctx->model.dirty;
+}
+
+const char *ghost_text(const editor_ctx_t *ctx, size_t *len) {
+    if (!ghost_active(ctx)) return NULL;
+    *len = ctx->model.ghost->len;
+    return ctx->model.ghost->text;
+}
+
+int ghost_accept(editor_ctx_t *ctx) {
+    if (!ghost_active(ctx) || ctx->model.ghost->len == 0) {
+        ghost_clear(ctx);
+        return 0;
+    }
+    /* Taken over before it goes: the insert is one edit of all of it */
+    Ghost *g = ctx->model.ghost;
+    char *text = g->text;
+    size_t len = g->len;
+    int row = g->row, col = g->col;
+    g->text = NULL;
+    ghost_clear(ctx);
+
+    editor_cursor_to(ctx, row, col);
+    editor_insert_text(ctx, text, len);
+    free(text);
+    return 1;
+}
+
+int ghost_row(const EditorModel *model, int filerow, const char **text,
+              int *len, int *more) {
+    const Ghost *g = model->ghost;
+    if (g == NULL || g->row != filerow || g->dirty != model->dirty) return 0;
+    if (g->shown_len == 0 && g->lines == 0) return 0;
+    *text = g->shown;
+    *len = g->shown_len;
+    *more = g->lines;
+    return 1;
+}
+
+int ghost_label(char *buf, size_t size, int more) {
+    int n = snprintf(buf, size, "  [+%d line%s]", more, more == 1 ? "" : "s");
+    return n < (int)size ? n : (int)size - 1;
+}
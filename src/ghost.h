@@ -0,0 +1,62 @@
+/* ghost.h - Inline suggestions shown in the view, not in the buffer
+ *
+ * A ghost is text proposed for insertion at a position of the buffer (an
+ * AI completion, say), drawn dimmed after the text of its row without
+ * being part of the rows: nothing is highlighted, recorded for undo or
+ * journalled while it is shown, and a search or a save does not see it.
+ * Its first line is drawn, then "[+N lines]" if it has more.
+ *
+ * Text streamed in a token at a time goes to ghost_append(), which only
+ * stamps the row the ghost is on as damaged (editor_row_damage()), so a
+ * frame rebuilds that one row and repeats the others. ghost_accept()
+ * inserts all of it with one editor_insert_text() at its position: one
+ * edit, one highlight update, one undo entry.
+ *
+ * A ghost belongs to the position it was shown at: an edit anywhere in
+ * the buffer leaves it stale, no longer drawn nor accepted. In INSERT
+ * mode TAB accepts it and any other key drops it. Lua has it as
+ * loki.ghost_show() and friends.
+ */
+
+#ifndef LOKI_GHOST_H
+#define LOKI_GHOST_H
+
+#include "internal.h"
+#include <stddef.h>
+
+typedef struct Ghost Ghost;
+
+/* Show 'len' bytes of 'text' at document position (row, col), in place
+ * of any ghost shown. */
+void ghost_show(editor_ctx_t *ctx, int row, int col, const char *text, size_t len);
+
+/* Add 'len' bytes to the ghost shown, or show them at the cursor if
+ * there is none. */
+void ghost_append(editor_ctx_t *ctx, const char *text, size_t len);
+
+/* Drop the ghost, if any */
+void ghost_clear(editor_ctx_t *ctx);
+
+/* A ghost is shown, and not stale */
+int ghost_active(const editor_ctx_t *ctx);
+
+/* The text of the ghost shown, *len bytes long, or NULL */
+const char *ghost_text(const editor_ctx_t *ctx, size_t *len);
+
+/* Insert the ghost at its position and put the cursor after it, as one
+ * undo step; the ghost goes. Returns 1 if there was one to insert. */
+int ghost_accept(editor_ctx_t *ctx);
+
+/* What row 'filerow' shows after its text: if the ghost is on it, sets
+ * *text to its first line as drawn (tabs expanded, control characters
+ * left out), *len bytes, and *more to the lines after it, and returns 1 */
+int ghost_row(const EditorModel *model, int filerow, const char **text,
+              int *len, int *more);
+
+/* What a ghost of 'more' further lines shows after its first one */
+int ghost_label(char *buf, size_t size, int more);
+
+/* Release a buffer's ghost. Safe on NULL. */
+void ghost_free(Ghost *g);
+
+#endif /* LOKI_GHOST_H */
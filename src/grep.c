@@ -0,0 +1,841 @@
+/* grep.c - Project-wide search
+ *
+ * See grep.h for an overview. A GrepJob owns the workers of one search.
+ * Workers share only the deques (each behind its own mutex), the count of
+ * pending tasks and the cancel flag. Results leave a worker in GrepBatch
+ * blocks, either through the async event queue (grep_start()) or through
+ * a list that the calling thread drains (grep_run()).
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE     /* d_type, getline(), nanosleep() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <uv.h>
+#include <stdatomic.h>
+
+#include "grep.h"
+#include "buffers.h"
+#include "loader.h"
+#include "regexp.h"
+#include "search.h"
+#include "terminal.h"
+#include "task_pool.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Files up to this size are read into the worker's buffer instead of
+ * mapped: for small files, setting up and tearing down a mapping costs
+ * more than the copy */
+#define GREP_READ_MAX (64 * 1024)
+
+/* Values of GrepJob.cancel */
+enum { GREP_RUNNING, GREP_CANCELLED, GREP_STOPPING };
+
+enum { GREP_EVENT_BATCH, GREP_EVENT_DONE };
+
+/* One matching line within a batch's text */
+typedef struct GrepHit {
+    int start;              /* Offset of the result line; the path is first */
+    int path_len;
+    int line, col;          /* 1-based */
+    int text_off;           /* The matching line itself */
+    int text_len;
+} GrepHit;
+
+/* Results found by one worker since its last hand-over */
+typedef struct GrepBatch {
+    struct abuf text;       /* "path:line:col: text\n" per hit */
+    GrepHit *hits;
+    int nhits, cap;
+    struct GrepBatch *next;
+} GrepBatch;
+
+/* A directory or file to visit, relative to the root ("" is the root) */
+typedef struct GrepTask {
+    char *path;
+    int dir;
+} GrepTask;
+
+typedef struct GrepWorker {
+    struct GrepJob *job;
+    Task *task;
+    uv_mutex_t lock;        /* Guards the deque */
+    GrepTask *tasks;        /* Deque: owner at hi, thieves at lo */
+    int lo, hi, cap;
+    Regexp *re;             /* Own copy: searching fills its state cache */
+    GrepBatch *batch;
+    uint64_t flushed;       /* uv_hrtime() of the last hand-over */
+    char path[PATH_MAX];    /* Scratch for full paths */
+    char buf[GREP_READ_MAX];    /* Contents of a small file */
+} GrepWorker;
+
+typedef struct GrepJob {
+    int id;
+    int buffer_id;          /* Results buffer; 0 for grep_run() */
+    char *prefix;           /* Prepended to task paths: root and '/' */
+    char *needle;           /* Literal searches */
+    SearchPattern lit;
+    GrepIgnore *ignore;     /* NULL when the root is a file */
+    GrepWorker *workers;
+    int nworkers;
+    int launched;           /* Workers submitted to the task pool */
+    atomic_long pending;    /* Tasks queued or being visited */
+    atomic_long files;      /* Files searched */
+    atomic_int running;     /* Workers still going, plus the launcher */
+    atomic_int cancel;
+    /* grep_run(): batches waiting for the calling thread */
+    uv_mutex_t out_lock;
+    uv_cond_t out_cond;
+    GrepBatch *out_head, **out_tail;
+    /* Main thread only (grep_start()) */
+    long matches;
+} GrepJob;
+
+static GrepJob *grep_job = NULL;    /* The background search, if any */
+static int grep_next_id = 1;
+
+/* ======================== Skip list ======================== */
+
+typedef struct GrepRule {
+    char *pattern;
+    int negate;             /* "!pattern" */
+    int dir_only;           /* "pattern/" */
+    int anchored;           /* Matches the whole path from the root */
+    int any_depth;          /* "**" + "/pattern": anchored at any directory */
+} GrepRule;
+
+struct GrepIgnore {
+    GrepRule *rules;
+    int count, cap;
+};
+
+/* Skipped even without a .gitignore */
+static const char *grep_builtin_ignores[] = {".git/", ".hg/", ".svn/", NULL};
+
+void grep_ignore_add(GrepIgnore *ig, const char *line) {
+    size_t len = strlen(line);
+    while (len && isspace((unsigned char)line[len - 1])) len--;
+    if (len == 0 || line[0] == '#') return;
+
+    GrepRule r = {0};
+    const char *p = line;
+    if (*p == '!') { r.negate = 1; p++; len--; }
+    if (len && p[len - 1] == '/') { r.dir_only = 1; len--; }
+    /* "dir/" followed by two stars is everything inside dir: skipping dir
+     * skips all of it */
+    if (len > 3 && memcmp(p + len - 3, "/**", 3) == 0) {
+        r.dir_only = 1;
+        len -= 3;
+    }
+    if (len >= 3 && memcmp(p, "**/", 3) == 0) {
+        p += 3;
+        len -= 3;
+        r.any_depth = memchr(p, '/', len) != NULL;
+        r.anchored = r.any_depth;
+    } else if (len && p[0] == '/') {
+        p++;
+        len--;
+        r.anchored = 1;
+    } else {
+        r.anchored = memchr(p, '/', len) != NULL;
+    }
+    if (len == 0) return;
+
+    if (ig->count == ig->cap) {
+        int cap = ig->cap ? ig->cap * 2 : 16;
+        GrepRule *rules = realloc(ig->rules, sizeof(*rules) * (size_t)cap);
+        if (!rules) {
+            perror("Out of memory");
+            exit(1);
+        }
+        ig->rules = rules;
+        ig->cap = cap;
+    }
+    r.pattern = malloc(len + 1);
+    if (!r.pattern) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(r.pattern, p, len);
+    r.pattern[len] = '\0';
+    ig->rules[ig->count++] = r;
+}
+
+GrepIgnore *grep_ignore_load(const char *root) {
+    GrepIgnore *ig = calloc(1, sizeof(*ig));
+    if (!ig) return NULL;
+    for (int i = 0; grep_builtin_ignores[i]; i++)
+        grep_ignore_add(ig, grep_builtin_ignores[i]);
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/.gitignore", root) >= (int)sizeof(path))
+        return ig;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return ig;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1) grep_ignore_add(ig, line);
+    free(line);
+    fclose(fp);
+    return ig;
+}
+
+int grep_ignore_match(const GrepIgnore *ig, const char *relpath, int is_dir) {
+    const char *base = strrchr(relpath, '/');
+    base = base ? base + 1 : relpath;
+
+    int skip = 0;
+    for (int i = 0; i < ig->count; i++) {
+        const GrepRule *r = &ig->rules[i];
+        if (r->dir_only && !is_dir) continue;
+        if (r->negate != skip) continue;    /* Would not change the verdict */
+
+        int hit = 0;
+        if (!r->anchored) {
+            hit = fnmatch(r->pattern, base, 0) == 0;
+        } else if (!r->any_depth) {
+            hit = fnmatch(r->pattern, relpath, FNM_PATHNAME) == 0;
+        } else {
+            for (const char *s = relpath; s && !hit; s = strchr(s, '/')) {
+                if (*s == '/') s++;
+                hit = fnmatch(r->pattern, s, FNM_PATHNAME) == 0;
+            }
+        }
+        if (hit) skip = !r->negate;
+    }
+    return skip;
+}
+
+void grep_ignore_free(GrepIgnore *ig) {
+    if (!ig) return;
+    for (int i = 0; i < ig->count; i++) free(ig->rules[i].pattern);
+    free(ig->rules);
+    free(ig);
+}
+
+/* ======================== Batches ======================== */
+
+static void batch_free(GrepBatch *b) {
+    if (!b) return;
+    terminal_buffer_free(&b->text);
+    free(b->hits);
+    free(b);
+}
+
+static void grep_emit(GrepWorker *w, const char *path, int line, int col,
+                      const char *text, int len) {
+    GrepBatch *b = w->batch;
+    if (!b) {
+        b = w->batch = calloc(1, sizeof(*b));
+        if (!b) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    if (b->nhits == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        GrepHit *hits = realloc(b->hits, sizeof(*hits) * (size_t)cap);
+        if (!hits) {
+            perror("Out of memory");
+            exit(1);
+        }
+        b->hits = hits;
+        b->cap = cap;
+    }
+    if (len > GREP_MAX_LINE) len = GREP_MAX_LINE;
+
+    GrepHit *h = &b->hits[b->nhits++];
+    char num[32];
+    int n = snprintf(num, sizeof(num), ":%d:%d: ", line, col);
+    h->start = b->text.len;
+    h->path_len = (int)strlen(path);
+    h->line = line;
+    h->col = col;
+    terminal_buffer_append(&b->text, path, h->path_len);
+    terminal_buffer_append(&b->text, num, n);
+    h->text_off = b->text.len;
+    h->text_len = len;
+    terminal_buffer_append(&b->text, text, len);
+    terminal_buffer_append(&b->text, "\n", 1);
+}
+
+static void push_grep_event(GrepJob *job, int kind, GrepBatch *b) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = GREP_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+    ev.data.user.i64[1] = kind;
+    ev.data.user.ptr = b;
+
+    /* Results are dropped once the search is cancelled; completion only
+     * when grep_stop_all() is already waiting for the workers. */
+    while (async_queue_push(NULL, &ev) != 0) {
+        int cancel = atomic_load(&job->cancel);
+        if (cancel == GREP_STOPPING ||
+            (kind == GREP_EVENT_BATCH && cancel != GREP_RUNNING)) {
+            batch_free(b);
+            return;
+        }
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Hand the worker's results over. */
+static void grep_flush(GrepWorker *w) {
+    GrepBatch *b = w->batch;
+    if (!b) return;
+    GrepJob *job = w->job;
+    w->batch = NULL;
+    w->flushed = uv_hrtime();
+
+    if (job->buffer_id) {
+        push_grep_event(job, GREP_EVENT_BATCH, b);
+        return;
+    }
+    uv_mutex_lock(&job->out_lock);
+    *job->out_tail = b;
+    job->out_tail = &b->next;
+    uv_cond_signal(&job->out_cond);
+    uv_mutex_unlock(&job->out_lock);
+}
+
+/* The last worker out reports the search done. */
+static void grep_worker_done(GrepJob *job) {
+    if (atomic_fetch_sub(&job->running, 1) != 1) return;
+    if (job->buffer_id) {
+        push_grep_event(job, GREP_EVENT_DONE, NULL);
+        return;
+    }
+    uv_mutex_lock(&job->out_lock);
+    uv_cond_signal(&job->out_cond);
+    uv_mutex_unlock(&job->out_lock);
+}
+
+/* ======================== Workers ======================== */
+
+static void grep_push(GrepWorker *w, char *path, int dir) {
+    atomic_fetch_add(&w->job->pending, 1);
+    uv_mutex_lock(&w->lock);
+    if (w->hi == w->cap) {
+        if (w->lo > w->cap / 2) {
+            memmove(w->tasks, w->tasks + w->lo,
+                    sizeof(*w->tasks) * (size_t)(w->hi - w->lo));
+            w->hi -= w->lo;
+            w->lo = 0;
+        } else {
+            int cap = w->cap ? w->cap * 2 : 64;
+            GrepTask *tasks = realloc(w->tasks, sizeof(*tasks) * (size_t)cap);
+            if (!tasks) {
+                perror("Out of memory");
+                exit(1);
+            }
+            w->tasks = tasks;
+            w->cap = cap;
+        }
+    }
+    w->tasks[w->hi].path = path;
+    w->tasks[w->hi].dir = dir;
+    w->hi++;
+    uv_mutex_unlock(&w->lock);
+}
+
+/* Take the newest task of 'w', or else the oldest task of another worker
+ * (near the root, so likely a big subtree). Returns 0 if all are empty. */
+static int grep_take(GrepWorker *w, GrepTask *t) {
+    GrepJob *job = w->job;
+    int self = (int)(w - job->workers);
+    for (int k = 0; k < job->nworkers; k++) {
+        GrepWorker *v = &job->workers[(self + k) % job->nworkers];
+        uv_mutex_lock(&v->lock);
+        int ok = v->hi > v->lo;
+        if (ok) *t = v == w ? v->tasks[--v->hi] : v->tasks[v->lo++];
+        if (v->lo == v->hi) v->lo = v->hi = 0;
+        uv_mutex_unlock(&v->lock);
+        if (ok) return 1;
+    }
+    return 0;
+}
+
+/* The path to open for task path 'rel', in w->path; NULL if too long. */
+static const char *grep_full_path(GrepWorker *w, const char *rel) {
+    int n = snprintf(w->path, sizeof(w->path), "%s%s", w->job->prefix, rel);
+    if (n >= (int)sizeof(w->path)) return NULL;
+    return n ? w->path : ".";
+}
+
+static void grep_walk(GrepWorker *w, const char *rel) {
+    GrepJob *job = w->job;
+    const char *path = grep_full_path(w, rel);
+    DIR *d = path ? opendir(path) : NULL;
+    if (!d) return;
+
+    size_t rlen = strlen(rel);
+    struct dirent *e;
+    while ((e = readdir(d)) && atomic_load(&job->cancel) == GREP_RUNNING) {
+        const char *name = e->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+
+        size_t nlen = strlen(name);
+        char *child = malloc(rlen + nlen + 2);
+        if (!child) {
+            perror("Out of memory");
+            exit(1);
+        }
+        size_t off = 0;
+        if (rlen) {
+            memcpy(child, rel, rlen);
+            child[rlen] = '/';
+            off = rlen + 1;
+        }
+        memcpy(child + off, name, nlen + 1);
+
+        /* Directories and regular files only; symlinks are not followed */
+        int kind = -1;
+#ifdef DT_UNKNOWN
+        if (e->d_type == DT_DIR) kind = 1;
+        else if (e->d_type == DT_REG) kind = 0;
+        else if (e->d_type == DT_UNKNOWN)
+#endif
+        {
+            struct stat st;
+            const char *full = grep_full_path(w, child);
+            if (full && lstat(full, &st) == 0)
+                kind = S_ISDIR(st.st_mode) ? 1 : S_ISREG(st.st_mode) ? 0 : -1;
+        }
+
+        if (kind < 0 || grep_ignore_match(job->ignore, child, kind)) {
+            free(child);
+            continue;
+        }
+        grep_push(w, child, kind);
+    }
+    closedir(d);
+}
+
+/* Report the first match on each line of 'data'. */
+static void grep_scan(GrepWorker *w, const char *path, const char *data,
+                      size_t size) {
+    GrepJob *job = w->job;
+    const char *p = data, *end = data + size;
+    int line = 1;
+
+    while (p < end && atomic_load(&job->cancel) == GREP_RUNNING) {
+        const char *m = NULL;
+        if (job->needle) {
+            /* One search over the rest of the file, then catch up on lines */
+            m = search_pattern_find(&job->lit, p, (size_t)(end - p));
+            if (!m) return;
+            const char *nl;
+            while ((nl = memchr(p, '\n', (size_t)(m - p)))) {
+                line++;
+                p = nl + 1;
+            }
+        }
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        size_t len = (size_t)(eol - p);
+        if (len && p[len - 1] == '\r') len--;
+        if (len > INT_MAX) len = INT_MAX;
+
+        int start, stop;
+        if (m) {
+            grep_emit(w, path, line, (int)(m - p) + 1, p, (int)len);
+        } else if (!job->needle &&
+                   regexp_search(w->re, p, (int)len, 0, &start, &stop)) {
+            grep_emit(w, path, line, start + 1, p, (int)len);
+        }
+        p = eol + 1;
+        line++;
+    }
+}
+
+/* Read up to 'cap' bytes; a short count means end of file or an error. */
+static size_t read_small(int fd, char *buf, size_t cap) {
+    size_t len = 0;
+    while (len < cap) {
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n > 0) len += (size_t)n;
+        else if (n == 0 || errno != EINTR) break;
+    }
+    return len;
+}
+
+static void grep_file(GrepWorker *w, const char *rel) {
+    const char *path = grep_full_path(w, rel);
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd == -1) return;
+
+    struct stat st;
+    LoadedFile file = {0};
+    if (fstat(fd, &st) == 0 && st.st_size <= GREP_READ_MAX) {
+        file.data = w->buf;
+        file.size = read_small(fd, w->buf, sizeof(w->buf));
+        close(fd);
+    } else {
+        close(fd);
+        if (loader_open(path, &file) != 0) return;
+    }
+    if (file.size && !loader_is_binary(&file))
+        grep_scan(w, path, file.data, file.size);
+    if (file.data != w->buf) loader_close(&file);
+    atomic_fetch_add(&w->job->files, 1);
+}
+
+static void grep_worker(void *arg) {
+    GrepWorker *w = arg;
+    GrepJob *job = w->job;
+    GrepTask t;
+
+    w->flushed = uv_hrtime();
+    while (atomic_load(&job->cancel) == GREP_RUNNING) {
+        if (!grep_take(w, &t)) {
+            /* Idle: show what we have, and stop once nobody has work left
+             * (a task being visited may still queue more) */
+            grep_flush(w);
+            if (atomic_load(&job->pending) == 0) break;
+            struct timespec ts = {0, 100000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        if (t.dir) grep_walk(w, t.path);
+        else grep_file(w, t.path);
+        free(t.path);
+        atomic_fetch_sub(&job->pending, 1);
+
+        if (w->batch && (w->batch->text.len >= GREP_FLUSH_BYTES ||
+                         uv_hrtime() - w->flushed >=
+                             (uint64_t)GREP_FLUSH_MS * 1000000))
+            grep_flush(w);
+    }
+    grep_flush(w);
+    grep_worker_done(job);
+}
+
+/* ======================== Jobs ======================== */
+
+static void grep_job_free(GrepJob *job) {
+    for (int i = 0; i < job->launched; i++)
+        task_wait(job->workers[i].task);
+    for (int i = 0; i < job->nworkers; i++) {
+        GrepWorker *w = &job->workers[i];
+        for (int j = w->lo; j < w->hi; j++) free(w->tasks[j].path);
+        free(w->tasks);
+        regexp_free(w->re);
+        batch_free(w->batch);
+        uv_mutex_destroy(&w->lock);
+    }
+    while (job->out_head) {
+        GrepBatch *b = job->out_head;
+        job->out_head = b->next;
+        batch_free(b);
+    }
+    uv_cond_destroy(&job->out_cond);
+    uv_mutex_destroy(&job->out_lock);
+    grep_ignore_free(job->ignore);
+    free(job->workers);
+    free(job->prefix);
+    free(job->needle);
+    free(job);
+}
+
+static int grep_worker_count(void) {
+    int n = task_pool_threads();
+    if (n > GREP_MAX_WORKERS) n = GREP_MAX_WORKERS;
+    return n;
+}
+
+/* Set up a search of 'root' for 'pattern' with its first task queued.
+ * Returns NULL with *error set if the root or the pattern is invalid. */
+static GrepJob *grep_job_new(const char *pattern, const char *root,
+                             int flags, const char **error) {
+    struct stat st;
+    if (stat(root, &st) != 0) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        *error = "Not a file or directory";
+        return NULL;
+    }
+
+    GrepJob *job = calloc(1, sizeof(*job));
+    if (!job) {
+        perror("Out of memory");
+        exit(1);
+    }
+    job->nworkers = grep_worker_count();
+    job->workers = calloc((size_t)job->nworkers, sizeof(*job->workers));
+    size_t rlen = strlen(root);
+    while (rlen > 1 && root[rlen - 1] == '/') rlen--;
+    job->prefix = malloc(rlen + 2);
+    if (!job->workers || !job->prefix) {
+        perror("Out of memory");
+        exit(1);
+    }
+    uv_mutex_init(&job->out_lock);
+    uv_cond_init(&job->out_cond);
+    job->out_tail = &job->out_head;
+    for (int i = 0; i < job->nworkers; i++) {
+        job->workers[i].job = job;
+        uv_mutex_init(&job->workers[i].lock);
+    }
+    atomic_init(&job->pending, 0);
+    atomic_init(&job->files, 0);
+    atomic_init(&job->running, 0);
+    atomic_init(&job->cancel, GREP_RUNNING);
+
+    /* Task paths are relative to the root, so results read "src/x.c"
+     * when searching ".", and "dir/src/x.c" when searching "dir" */
+    char *first;
+    if (S_ISDIR(st.st_mode)) {
+        memcpy(job->prefix, root, rlen);
+        job->prefix[rlen] = '\0';
+        job->ignore = grep_ignore_load(job->prefix);
+        if (!job->ignore) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (strcmp(job->prefix, ".") == 0) job->prefix[0] = '\0';
+        else if (strcmp(job->prefix, "/") != 0) strcat(job->prefix, "/");
+        first = strdup("");
+    } else {
+        job->prefix[0] = '\0';
+        first = strdup(root);
+    }
+    if (!first) {
+        perror("Out of memory");
+        exit(1);
+    }
+    grep_push(&job->workers[0], first, S_ISDIR(st.st_mode));
+
+    if (flags & GREP_LITERAL) {
+        job->needle = strdup(pattern);
+        if (!job->needle) {
+            perror("Out of memory");
+            exit(1);
+        }
+        search_pattern_init_icase(&job->lit, job->needle,
+                                  (int)strlen(job->needle),
+                                  (flags & GREP_ICASE) != 0);
+        return job;
+    }
+
+    int re_flags = (flags & GREP_ICASE) ? REGEXP_ICASE : 0;
+    for (int i = 0; i < job->nworkers; i++) {
+        job->workers[i].re = regexp_compile(pattern, re_flags, error);
+        if (!job->workers[i].re) {
+            grep_job_free(job);
+            return NULL;
+        }
+    }
+    return job;
+}
+
+/* Start the job's workers. Returns -1 if not even one thread started. */
+static int grep_job_launch(GrepJob *job) {
+    /* The launcher holds one count until every worker is up, so none can
+     * see the search done while others are still starting */
+    atomic_store(&job->running, 1);
+    for (int i = 0; i < job->nworkers; i++) {
+        atomic_fetch_add(&job->running, 1);
+        job->workers[i].task = task_submit(grep_worker, &job->workers[i],
+                                           TASK_PRIORITY_NORMAL, NULL);
+        if (job->workers[i].task == NULL) {
+            atomic_fetch_sub(&job->running, 1);
+            break;
+        }
+        job->launched++;
+    }
+    if (job->launched == 0) return -1;
+    grep_worker_done(job);
+    return 0;
+}
+
+long grep_run(const char *pattern, const char *root, int flags,
+              grep_match_fn fn, void *arg, const char **error) {
+    GrepJob *job = grep_job_new(pattern, root, flags, error);
+    if (!job) return -1;
+    if (grep_job_launch(job) != 0) {
+        *error = "Can't start worker threads";
+        grep_job_free(job);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    uv_mutex_lock(&job->out_lock);
+    for (;;) {
+        while (!job->out_head && atomic_load(&job->running) > 0)
+            uv_cond_wait(&job->out_cond, &job->out_lock);
+        GrepBatch *b = job->out_head;
+        if (!b) break;
+        job->out_head = b->next;
+        if (!job->out_head) job->out_tail = &job->out_head;
+        uv_mutex_unlock(&job->out_lock);
+
+        for (int i = 0; i < b->nhits &&
+                        atomic_load(&job->cancel) == GREP_RUNNING; i++) {
+            const GrepHit *h = &b->hits[i];
+            memcpy(path, b->text.b + h->start, (size_t)h->path_len);
+            path[h->path_len] = '\0';
+            GrepMatch m = {path, h->line, h->col, b->text.b + h->text_off,
+                           h->text_len};
+            if (fn(&m, arg)) atomic_store(&job->cancel, GREP_CANCELLED);
+        }
+        batch_free(b);
+        uv_mutex_lock(&job->out_lock);
+    }
+    uv_mutex_unlock(&job->out_lock);
+
+    long files = atomic_load(&job->files);
+    grep_job_free(job);
+    return files;
+}
+
+/* ======================== Results buffer ======================== */
+
+static void grep_append(editor_ctx_t *ctx, const GrepBatch *b) {
+    for (int i = 0; i < b->nhits; i++) {
+        const GrepHit *h = &b->hits[i];
+        int len = h->text_off + h->text_len - h->start;
+        editor_insert_row(ctx, ctx->model.numrows, b->text.b + h->start,
+                          (size_t)len);
+    }
+    ctx->model.dirty = 0;
+}
+
+static void grep_report(editor_ctx_t *ctx, long matches, long files, int done) {
+    editor_set_status_msg(ctx, "grep: %ld match%s in %ld file%s%s", matches,
+                          matches == 1 ? "" : "es", files, files == 1 ? "" : "s",
+                          done ? "" : "...");
+}
+
+static void grep_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    GrepBatch *b = event->data.user.ptr;
+    GrepJob *job = grep_job;
+    if (!job || job->id != (int)event->data.user.i64[0]) {
+        batch_free(b);  /* From a search that has been stopped */
+        return;
+    }
+
+    editor_ctx_t *ctx = buffer_get(job->buffer_id);
+    if (event->data.user.i64[1] == GREP_EVENT_DONE) {
+        grep_job = NULL;
+        if (ctx) grep_report(ctx, job->matches, atomic_load(&job->files), 1);
+        grep_job_free(job);
+        return;
+    }
+    if (!ctx) {
+        /* The results buffer was closed */
+        atomic_store(&job->cancel, GREP_CANCELLED);
+    } else {
+        grep_append(ctx, b);
+        job->matches += b->nhits;
+        grep_report(ctx, job->matches, atomic_load(&job->files), 0);
+    }
+    batch_free(b);
+}
+
+static int grep_append_match(const GrepMatch *m, void *arg) {
+    editor_ctx_t *ctx = arg;
+    char num[32];
+    int n = snprintf(num, sizeof(num), ":%d:%d: ", m->line, m->col);
+    struct abuf ab = ABUF_INIT;
+    terminal_buffer_append(&ab, m->path, (int)strlen(m->path));
+    terminal_buffer_append(&ab, num, n);
+    terminal_buffer_append(&ab, m->text, m->len);
+    editor_insert_row(ctx, ctx->model.numrows, ab.b, (size_t)ab.len);
+    terminal_buffer_free(&ab);
+    return 0;
+}
+
+void grep_stop_all(void) {
+    GrepJob *job = grep_job;
+    if (!job) return;
+    grep_job = NULL;
+    atomic_store(&job->cancel, GREP_STOPPING);
+    grep_job_free(job);
+}
+
+int grep_start(editor_ctx_t *ctx, const char *pattern, const char *root,
+               int flags) {
+    grep_stop_all();
+
+    const char *error = NULL;
+    GrepJob *job = NULL;
+    if (async_queue_global() != NULL) {
+        job = grep_job_new(pattern, root, flags, &error);
+        if (!job) {
+            editor_set_status_msg(ctx, "grep: %s", error);
+            return -1;
+        }
+    }
+
+    int id = buffer_create(NULL);
+    editor_ctx_t *results = id >= 0 ? buffer_get(id) : NULL;
+    if (!results) {
+        if (job) grep_job_free(job);
+        editor_set_status_msg(ctx, "grep: Can't open a buffer for the results");
+        return -1;
+    }
+    /* The first row says what was searched */
+    struct abuf header = ABUF_INIT;
+    terminal_buffer_append(&header, "grep ", 5);
+    terminal_buffer_append(&header, pattern, (int)strlen(pattern));
+    terminal_buffer_append(&header, " ", 1);
+    terminal_buffer_append(&header, root, (int)strlen(root));
+    editor_del_row(results, 0);
+    editor_insert_row(results, 0, header.b, (size_t)header.len);
+    terminal_buffer_free(&header);
+    results->model.dirty = 0;
+
+    if (!job) {
+        /* No event loop (tests, headless sessions): search in place */
+        long files = grep_run(pattern, root, flags, grep_append_match,
+                              results, &error);
+        if (files < 0) {
+            buffer_close(id, 1);
+            editor_set_status_msg(ctx, "grep: %s", error);
+            return -1;
+        }
+        results->model.dirty = 0;
+        buffer_switch(id);
+        grep_report(results, results->model.numrows - 1, files, 1);
+        return 0;
+    }
+
+    job->id = grep_next_id++;
+    job->buffer_id = id;
+    if (async_queue_get_handler(NULL, GREP_ASYNC_EVENT) != grep_event_handler) {
+        async_queue_set_handler_lane(NULL, GREP_ASYNC_EVENT, grep_event_handler,
+                                     ASYNC_LANE_LOW);
+        async_event_set_type_name(GREP_ASYNC_EVENT, "grep");
+    }
+    if (grep_job_launch(job) != 0) {
+        grep_job_free(job);
+        buffer_close(id, 1);
+        editor_set_status_msg(ctx, "grep: Can't start worker threads");
+        return -1;
+    }
+    grep_job = job;
+    buffer_switch(id);
+    grep_report(results, 0, 0, 0);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* grep.h - Project-wide search (:grep and loki.grep())
+ *
+ * A search walks a directory tree on a pool of worker threads. Every
+ * directory and file still to look at is a task on some worker's deque: a
+ * worker takes its newest task, and when it has none steals the oldest
+ * from another worker, so one huge directory spreads over the whole pool.
+ * Files are mapped with loader_open() and skipped when loader_is_binary()
+ * says they are binary, as editor_open() does. Symlinks are not followed.
+ *
+ * Paths on the skip list are not entered: version control directories,
+ * plus the patterns of the root's .gitignore (see grep_ignore_match()).
+ *
+ * Each matching line is reported once, as "path:line:col: text".
+ * grep_start() streams these lines through the async event queue into a
+ * results buffer while the editor stays live; grep_run() runs the same
+ * search to completion and hands each match to a callback on the calling
+ * thread.
+ */
+
+#ifndef LOKI_GREP_H
+#define LOKI_GREP_H
+
+#include "internal.h"
+#include "async_queue.h"
+
+/* Async event carrying a batch of results (data.user.i64[0] = job id) */
+#define GREP_ASYNC_EVENT (ASYNC_EVENT_USER + 2)
+
+/* Worker threads per search */
+#define GREP_MAX_WORKERS 32
+
+/* A worker hands its results over once it has this many bytes of them,
+ * or after GREP_FLUSH_MS, whichever comes first */
+#define GREP_FLUSH_BYTES (64 * 1024)
+#define GREP_FLUSH_MS 50
+
+/* Matching lines are cut to this many bytes in the results */
+#define GREP_MAX_LINE 512
+
+/* Flags for grep_run() and grep_start() */
+#define GREP_LITERAL 1      /* The pattern is plain text, not a regex */
+#define GREP_ICASE 2        /* Ignore case: ASCII, and with GREP_LITERAL
+                             * the UTF-8 letters search.h folds */
+
+/* One matching line. 'text' is not NUL-terminated. */
+typedef struct GrepMatch {
+    const char *path;       /* As found from the root, e.g. "src/main.c" */
+    int line;               /* 1-based */
+    int col;                /* 1-based byte column of the match */
+    const char *text;       /* The line, cut to GREP_MAX_LINE bytes */
+    int len;
+} GrepMatch;
+
+/* Called for each match; return nonzero to stop the search. */
+typedef int (*grep_match_fn)(const GrepMatch *match, void *arg);
+
+/* Search the tree under 'root' for 'pattern' and wait for the result.
+ * Matches arrive in no particular order between files.
+ * Returns the number of files searched, or -1 if the pattern does not
+ * compile (*error set) or the search could not start (*error set). */
+long grep_run(const char *pattern, const char *root, int flags,
+              grep_match_fn fn, void *arg, const char **error);
+
+/* Start searching in the background into a new buffer, and switch to it.
+ * A search already running is cancelled. Closing the results buffer
+ * cancels the search too. Returns 0 if started, -1 on error (status
+ * message set). */
+int grep_start(editor_ctx_t *ctx, const char *pattern, const char *root,
+               int flags);
+
+/* Cancel the background search, if any, and wait for its workers. */
+void grep_stop_all(void);
+
+/* ======================== Skip list ======================== */
+
+typedef struct GrepIgnore GrepIgnore;
+
+/* Load the skip list for 'root': the built-in entries and the patterns in
+ * 'root'/.gitignore when there is one. Returns NULL if out of memory. */
+GrepIgnore *grep_ignore_load(const char *root);
+
+/* Add one .gitignore-style pattern line. Blank lines and lines starting
+ * with '#' are ignored. */
+void grep_ignore_add(GrepIgnore *ig, const char *line);
+
+/* Whether 'relpath' (relative to the root, '/'-separated) is skipped.
+ * Patterns follow .gitignore: one without a '/' matches the last path
+ * component at any depth, one with a '/' matches the whole path from the
+ * root, a trailing '/' matches only directories, and a leading '!' takes
+ * a path back off the list. The last pattern that matches decides. */
+int grep_ignore_match(const GrepIgnore *ig, const char *relpath, int is_dir);
+
+void grep_ignore_free(GrepIgnore *ig);
+
+#endif /* LOKI_GREP_H */
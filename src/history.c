@@ -0,0 +1,534 @@
+/* history.c - Command and REPL input history kept on disk
+ *
+ * See history.h for an overview. The log is mapped read-only as far as
+ * it was when last looked at; appends go through the descriptor, after
+ * which the mapping is redone to take them in. The index is an array by
+ * entry number, filled from the newest entry back as far as has been
+ * asked for, and forward as entries are added.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE     /* mkstemp(), flock() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+#include "loki.h"
+
+/* "LKHL" and "LKHR", as read from a little-endian file */
+#define LOG_MAGIC 0x4C484B4C
+#define RECORD_MAGIC 0x52484B4C
+#define LOG_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} log_header;
+
+/* The start of every record; the text, a NUL, padding to four bytes and
+ * then the record's length follow */
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;            /* Entries before it in the log */
+    uint32_t len;            /* Bytes of text */
+    uint32_t hash;           /* FNV-1a of the text */
+} record_header;
+
+#define RECORD_SIZE(len) \
+    (sizeof(record_header) + (((size_t)(len) + 4) & ~(size_t)3) + sizeof(uint32_t))
+
+/* An entry found */
+typedef struct {
+    uint32_t off;            /* Of its record */
+    uint32_t len;
+    uint32_t hash;
+    uint32_t head;           /* Its first four bytes, zero-padded */
+} entry_ix;
+
+struct HistoryLog {
+    char *path;              /* NULL: private */
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    const char *map;
+    size_t map_size;
+    size_t end;              /* Where the valid records end */
+    int count;               /* Entries */
+    entry_ix *ix;            /* By entry number: [lo, count) are known */
+    int lo;
+    int floor;               /* Oldest entry reachable */
+    int cap;
+};
+
+static char *history_dir = NULL;
+static int history_dir_set = 0;
+
+void history_set_dir(const char *dir) {
+    free(history_dir);
+    history_dir = dir ? strdup(dir) : NULL;
+    history_dir_set = dir != NULL;
+}
+
+static uint32_t text_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* ======================== Records ======================== */
+
+/* Length of the valid record at 'off', below 'limit', or 0 */
+static size_t record_at(const HistoryLog *h, size_t off, size_t limit,
+                        record_header *hdr) {
+    if (off < sizeof(log_header) || off > limit ||
+        limit - off < RECORD_SIZE(0))
+        return 0;
+    memcpy(hdr, h->map + off, sizeof(*hdr));
+    if (hdr->magic != RECORD_MAGIC || hdr->len > HISTORY_ENTRY_MAX) return 0;
+    size_t len = RECORD_SIZE(hdr->len);
+    if (len > limit - off) return 0;
+    uint32_t trailer;
+    memcpy(&trailer, h->map + off + len - sizeof(trailer), sizeof(trailer));
+    const char *text = h->map + off + sizeof(*hdr);
+    if (trailer != len || text[hdr->len] != '\0' ||
+        text_hash(text, hdr->len) != hdr->hash)
+        return 0;
+    return len;
+}
+
+/* The record ending at 'end', or 0 */
+static size_t record_before(const HistoryLog *h, size_t end,
+                            record_header *hdr, size_t *off) {
+    uint32_t len;
+    if (end < sizeof(log_header) + RECORD_SIZE(0)) return 0;
+    memcpy(&len, h->map + end - sizeof(len), sizeof(len));
+    if (len < RECORD_SIZE(0) || len > end - sizeof(log_header)) return 0;
+    *off = end - len;
+    return record_at(h, *off, end, hdr) == len ? len : 0;
+}
+
+static void index_entry(HistoryLog *h, size_t off, const record_header *hdr) {
+    entry_ix *e = &h->ix[hdr->seq];
+    e->off = (uint32_t)off;
+    e->len = hdr->len;
+    e->hash = hdr->hash;
+    e->head = 0;
+    memcpy(&e->head, h->map + off + sizeof(*hdr), hdr->len < 4 ? hdr->len : 4);
+}
+
+static void grow_index(HistoryLog *h, int need) {
+    if (need <= h->cap) return;
+    int cap = h->cap ? h->cap : 64;
+    while (cap < need) cap *= 2;
+    entry_ix *ix = realloc(h->ix, sizeof(*ix) * (size_t)cap);
+    if (!ix) {
+        perror("Out of memory");
+        exit(1);
+    }
+    h->ix = ix;
+    h->cap = cap;
+}
+
+/* Index entries back to number 'seq' (or as far as they go) */
+static void index_back(HistoryLog *h, int seq) {
+    while (h->lo > seq && h->lo > h->floor) {
+        size_t end = h->lo == h->count ? h->end : h->ix[h->lo].off;
+        record_header hdr;
+        size_t off;
+        if (!record_before(h, end, &hdr, &off) || (int)hdr.seq != h->lo - 1) {
+            h->floor = h->lo;
+            break;
+        }
+        index_entry(h, off, &hdr);
+        h->lo--;
+    }
+}
+
+/* ======================== Mapping ======================== */
+
+static void unmap(HistoryLog *h) {
+    if (h->map) munmap((void *)h->map, h->map_size);
+    h->map = NULL;
+    h->map_size = 0;
+}
+
+static int map_file(HistoryLog *h) {
+    struct stat st;
+    if (fstat(h->fd, &st) == -1) return -1;
+    unmap(h);
+    h->map_size = (size_t)st.st_size;
+    if (h->map_size == 0) return 0;
+    void *map = mmap(NULL, h->map_size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (map == MAP_FAILED) {
+        h->map_size = 0;
+        return -1;
+    }
+    h->map = map;
+    return 0;
+}
+
+/* Map the log afresh and find its last entry: its number tells how many
+ * there are. A record cut short at the end is left out. */
+static int load(HistoryLog *h) {
+    if (map_file(h) == -1) return -1;
+    h->end = sizeof(log_header);
+    h->count = h->lo = h->floor = 0;
+
+    record_header hdr;
+    size_t off, len;
+    if (h->map_size > h->end && !record_before(h, h->map_size, &hdr, &off)) {
+        /* Cut short: up to the last whole record */
+        while ((len = record_at(h, h->end, h->map_size, &hdr)) > 0) h->end += len;
+    } else {
+        h->end = h->map_size > h->end ? h->map_size : h->end;
+    }
+    if (h->end > sizeof(log_header) && record_before(h, h->end, &hdr, &off)) {
+        h->count = h->lo = (int)hdr.seq + 1;
+        grow_index(h, h->count + 1);
+    }
+    return 0;
+}
+
+/* Take in the records added past the end since it was mapped */
+static void catch_up(HistoryLog *h) {
+    struct stat st;
+    if (fstat(h->fd, &st) == -1 || (size_t)st.st_size == h->map_size) return;
+    if ((size_t)st.st_size < h->end) {
+        load(h);
+        return;
+    }
+    if (map_file(h) == -1) {
+        h->end = h->map_size = 0;
+        h->count = h->lo = h->floor = 0;
+        return;
+    }
+    record_header hdr;
+    size_t len;
+    while ((len = record_at(h, h->end, h->map_size, &hdr)) > 0 &&
+           (int)hdr.seq == h->count) {
+        grow_index(h, h->count + 1);
+        index_entry(h, h->end, &hdr);
+        h->count++;
+        h->end += len;
+    }
+}
+
+/* ======================== Opening ======================== */
+
+/* The directory logs go in, created if missing, or NULL */
+static char *resolve_dir(void) {
+    char dir[PATH_MAX];
+    struct stat st;
+    if (history_dir_set) {
+        if (history_dir == NULL || history_dir[0] == '\0') return NULL;
+        snprintf(dir, sizeof(dir), "%s", history_dir);
+    } else if (stat(LOKI_CONFIG_DIR, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(dir, sizeof(dir), "%s", LOKI_CONFIG_DIR);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) return NULL;
+        snprintf(dir, sizeof(dir), "%s/%s", home, LOKI_CONFIG_DIR);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+    return strdup(dir);
+}
+
+/* A new file for the log: beside 'path', or unlinked in $TMPDIR for a
+ * private one. Its name goes to 'tmp'. */
+static int create_file(const char *path, char *tmp, size_t tmplen) {
+    const char *dir = getenv("TMPDIR");
+    if (path) {
+        snprintf(tmp, tmplen, "%s.XXXXXX", path);
+    } else {
+        snprintf(tmp, tmplen, "%s/loki-history-XXXXXX", dir && *dir ? dir : "/tmp");
+    }
+    int fd = mkstemp(tmp);
+    if (fd == -1) return -1;
+    log_header hdr = { LOG_MAGIC, LOG_VERSION };
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (!path) unlink(tmp);
+    return fd;
+}
+
+/* Open the log at h->path (or a private one), starting it if it is new
+ * or not a log, and dropping a record cut short at its end */
+static int attach(HistoryLog *h) {
+    char tmp[PATH_MAX];
+    if (!h->path) {
+        h->fd = create_file(NULL, tmp, sizeof(tmp));
+        return h->fd == -1 ? -1 : load(h);
+    }
+
+    h->fd = open(h->path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (h->fd == -1 || flock(h->fd, LOCK_EX) == -1 || fstat(h->fd, &st) == -1)
+        return -1;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+
+    log_header hdr = {0};
+    if (pread(h->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != LOG_MAGIC || hdr.version != LOG_VERSION) {
+        hdr.magic = LOG_MAGIC;
+        hdr.version = LOG_VERSION;
+        if (ftruncate(h->fd, 0) == -1 ||
+            pwrite(h->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+            flock(h->fd, LOCK_UN);
+            return -1;
+        }
+    }
+    int ok = load(h);
+    if (ok == 0 && h->end < h->map_size && ftruncate(h->fd, (off_t)h->end) == 0)
+        ok = map_file(h);
+    flock(h->fd, LOCK_UN);
+    return ok;
+}
+
+static void detach(HistoryLog *h) {
+    unmap(h);
+    if (h->fd != -1) close(h->fd);
+    h->fd = -1;
+    h->end = 0;
+    h->count = h->lo = h->floor = 0;
+}
+
+HistoryLog *history_open_path(const char *path) {
+    HistoryLog *h = calloc(1, sizeof(*h));
+    if (!h) {
+        perror("Out of memory");
+        exit(1);
+    }
+    h->fd = -1;
+    h->path = path ? strdup(path) : NULL;
+    if (attach(h) == 0) return h;
+
+    /* Somewhere to keep it this session at least */
+    detach(h);
+    free(h->path);
+    h->path = NULL;
+    if (attach(h) == 0) return h;
+    history_close(h);
+    return NULL;
+}
+
+HistoryLog *history_open(const char *name) {
+    char *dir = resolve_dir();
+    if (!dir) return history_open_path(NULL);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s_history.log", dir, name);
+    free(dir);
+    return history_open_path(path);
+}
+
+void history_close(HistoryLog *h) {
+    if (!h) return;
+    detach(h);
+    free(h->ix);
+    free(h->path);
+    free(h);
+}
+
+/* Has the log at the path been replaced (rewritten, or removed)? */
+static int replaced(const HistoryLog *h) {
+    struct stat st;
+    if (!h->path) return 0;
+    return stat(h->path, &st) == -1 || st.st_dev != h->dev || st.st_ino != h->ino;
+}
+
+static void reattach(HistoryLog *h) {
+    detach(h);
+    if (attach(h) == -1) {
+        detach(h);
+        free(h->path);
+        h->path = NULL;
+        attach(h);
+    }
+}
+
+void history_refresh(HistoryLog *h) {
+    if (replaced(h)) reattach(h);
+    if (h->fd == -1 || flock(h->fd, LOCK_SH) == -1) return;
+    catch_up(h);
+    flock(h->fd, LOCK_UN);
+}
+
+/* Lock the log that is at the path now, for writing */
+static int lock_current(HistoryLog *h) {
+    for (int tries = 0; tries < 8; tries++) {
+        if (h->fd == -1) return -1;
+        if (flock(h->fd, LOCK_EX) == -1) return -1;
+        if (!replaced(h)) return 0;
+        flock(h->fd, LOCK_UN);
+        reattach(h);
+    }
+    return -1;
+}
+
+/* ======================== Reading ======================== */
+
+int history_count(const HistoryLog *h) {
+    return h->count;
+}
+
+static const char *entry_text(const HistoryLog *h, int seq) {
+    return h->map + h->ix[seq].off + sizeof(record_header);
+}
+
+const char *history_get(HistoryLog *h, int age) {
+    int seq = h->count - 1 - age;
+    if (age < 0 || seq < 0) return NULL;
+    index_back(h, seq);
+    return seq >= h->lo ? entry_text(h, seq) : NULL;
+}
+
+int history_find(HistoryLog *h, const char *prefix, size_t len, int from) {
+    uint32_t head = 0;
+    size_t head_len = len < 4 ? len : 4;
+    memcpy(&head, prefix, head_len);
+    uint32_t mask = head_len == 4 ? 0xFFFFFFFFu : 0;
+    if (head_len < 4) memset(&mask, 0xFF, head_len);
+
+    for (int age = from < 0 ? 0 : from; age < h->count; age++) {
+        int seq = h->count - 1 - age;
+        index_back(h, seq);
+        if (seq < h->lo) return -1;
+        const entry_ix *e = &h->ix[seq];
+        if (e->len < len || (e->head & mask) != head ||
+            memcmp(entry_text(h, seq), prefix, len) != 0)
+            continue;
+
+        /* Not one a newer match already gave */
+        int seen = 0;
+        for (int newer = seq + 1; newer < h->count && !seen; newer++) {
+            const entry_ix *n = &h->ix[newer];
+            seen = n->hash == e->hash && n->len == e->len &&
+                   memcmp(entry_text(h, newer), entry_text(h, seq), e->len) == 0;
+        }
+        if (!seen) return age;
+    }
+    return -1;
+}
+
+/* ======================== Writing ======================== */
+
+static size_t put_record(char *out, int seq, const char *text, size_t len) {
+    record_header hdr = { RECORD_MAGIC, (uint32_t)seq, (uint32_t)len,
+                          text_hash(text, len) };
+    uint32_t size = (uint32_t)RECORD_SIZE(len);
+    memset(out, 0, size);
+    memcpy(out, &hdr, sizeof(hdr));
+    memcpy(out + sizeof(hdr), text, len);
+    memcpy(out + size - sizeof(size), &size, sizeof(size));
+    return size;
+}
+
+/* Write the newest entries, up to 'keep' bytes of records, to a new file
+ * and put it in place of the log. Called with the log locked. */
+static int rewrite(HistoryLog *h, size_t keep) {
+    int first = h->count;
+    size_t bytes = 0;
+    while (first > 0) {
+        index_back(h, first - 1);
+        if (first - 1 < h->lo) break;
+        size_t size = RECORD_SIZE(h->ix[first - 1].len);
+        if (bytes + size > keep) break;
+        bytes += size;
+        first--;
+    }
+
+    char *buf = malloc(bytes ? bytes : 1);
+    if (!buf) {
+        perror("Out of memory");
+        exit(1);
+    }
+    size_t len = 0;
+    for (int seq = first; seq < h->count; seq++)
+        len += put_record(buf + len, seq - first, entry_text(h, seq), h->ix[seq].len);
+
+    char tmp[PATH_MAX];
+    int fd = create_file(h->path, tmp, sizeof(tmp));
+    if (fd == -1 || write(fd, buf, len) != (ssize_t)len ||
+        flock(fd, LOCK_EX) == -1 || (h->path && rename(tmp, h->path) == -1)) {
+        if (fd != -1) {
+            close(fd);
+            if (h->path) unlink(tmp);
+        }
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    /* Waiters on the old file will find it replaced */
+    struct stat st;
+    fstat(fd, &st);
+    detach(h);
+    h->fd = fd;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    return load(h);
+}
+
+/* Write the record of the next entry after the valid ones (dropping what
+ * a crash left past them) and take it in. Called with the log locked. */
+static int append_record(HistoryLog *h, const char *text, size_t len) {
+    char rec[RECORD_SIZE(HISTORY_ENTRY_MAX)];
+    size_t size = put_record(rec, h->count, text, len);
+    if (h->end < h->map_size && ftruncate(h->fd, (off_t)h->end) == -1) return -1;
+    if (pwrite(h->fd, rec, size, (off_t)h->end) != (ssize_t)size) {
+        /* Leave no partial record behind */
+        if (ftruncate(h->fd, (off_t)h->end) == -1) return -1;
+        return -1;
+    }
+    catch_up(h);
+    return 0;
+}
+
+int history_add(HistoryLog *h, const char *text) {
+    size_t len = strlen(text);
+    if (len == 0) return 0;
+    if (len > HISTORY_ENTRY_MAX) len = HISTORY_ENTRY_MAX;
+    if (lock_current(h) == -1) return -1;
+    catch_up(h);
+
+    int rc = 0;
+    const char *newest = history_get(h, 0);
+    if (newest && h->ix[h->count - 1].len == len && memcmp(newest, text, len) == 0)
+        goto done;
+
+    if (h->end + RECORD_SIZE(len) > HISTORY_LOG_MAX && rewrite(h, HISTORY_LOG_KEEP) == -1) {
+        rc = -1;
+        goto done;
+    }
+
+    rc = append_record(h, text, len);
+
+done:
+    flock(h->fd, LOCK_UN);
+    return rc;
+}
+
+int history_clear(HistoryLog *h) {
+    if (lock_current(h) == -1) return -1;
+    int rc = rewrite(h, 0);
+    flock(h->fd, LOCK_UN);
+    return rc;
+}
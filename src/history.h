@@ -0,0 +1,79 @@
+/* history.h - Command and REPL input history kept on disk
+ *
+ * Each history (':' commands, the Lua REPL's input) is a log in .loki/
+ * (the project's .loki/ if there is one, else ~/.loki/) named after it,
+ * "cmd_history.log" and so on: a header, then a record for each entry,
+ * never rewritten. Every record holds its entry's number, a hash of its
+ * text and the text with a NUL after it, and ends with its length, so the
+ * log is read from its end backwards.
+ *
+ * The log is memory-mapped, and opening it reads the last record only:
+ * its number is how many entries there are. Entries are found as Up or a
+ * search first goes back to them, and kept in an index of their offsets,
+ * hashes and first bytes, which prefix searches (Ctrl-R) go through,
+ * reading the text only of entries whose first bytes match.
+ *
+ * Any number of loki processes share a log. Appends are single writes
+ * under an exclusive lock, and history_refresh() maps the records others
+ * added since. A log grown past HISTORY_LOG_MAX is rewritten, under the
+ * lock, with its newest entries only, and renamed over the old one; the
+ * others notice the new file and open it. A record cut short by a crash
+ * is dropped from the end.
+ *
+ * Records are in the machine's byte order; the log is for the one
+ * machine, not an interchange format. With no .loki/ directory, or with
+ * persistence turned off, the history is kept in a private log that goes
+ * away with the process.
+ */
+
+#ifndef LOKI_HISTORY_H
+#define LOKI_HISTORY_H
+
+#include <stddef.h>
+
+/* Longest entry kept (longer ones are cut), the size a log is kept under,
+ * and the bytes of the newest entries kept when it grows past it */
+#define HISTORY_ENTRY_MAX 4096
+#define HISTORY_LOG_MAX ((size_t)1 << 20)
+#define HISTORY_LOG_KEEP (HISTORY_LOG_MAX / 2)
+
+typedef struct HistoryLog HistoryLog;
+
+/* Keep logs in 'dir' (created if missing) instead of .loki/, or turn
+ * persistence off with "". NULL goes back to the default. */
+void history_set_dir(const char *dir);
+
+/* Open (or create) the history 'name' ("cmd", "lua"), or a private one if
+ * there is nowhere to keep it. Returns NULL only if not even that can be
+ * made. */
+HistoryLog *history_open(const char *name);
+
+/* Open the log at 'path' itself, or a private one if NULL */
+HistoryLog *history_open_path(const char *path);
+
+/* Unmap and close. Safe on NULL. */
+void history_close(HistoryLog *h);
+
+/* Map the entries other processes added since the last call (or the log
+ * that replaced this one). Ages count from the newest entry again. */
+void history_refresh(HistoryLog *h);
+
+/* Entries in the log */
+int history_count(const HistoryLog *h);
+
+/* The entry 'age' back from the newest (0), or NULL. Valid until the
+ * next history_add(), history_refresh() or history_clear(). */
+const char *history_get(HistoryLog *h, int age);
+
+/* Append 'text' (not if it is empty, or the newest entry already).
+ * Returns 0, or -1 if it could not be written. */
+int history_add(HistoryLog *h, const char *text);
+
+/* Age of the newest entry from 'from' back that starts with the 'len'
+ * bytes of 'prefix' and differs from the newer entries that do, or -1 */
+int history_find(HistoryLog *h, const char *prefix, size_t len, int from);
+
+/* Drop every entry, for all processes sharing the log. Returns 0 or -1. */
+int history_clear(HistoryLog *h);
+
+#endif /* LOKI_HISTORY_H */
@@ -0,0 +1,173 @@
+/* hl_spans.c - Run-length encoded syntax highlight
+ *
+ * See hl_spans.h for an overview.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hl_spans.h"
+#include "memstats.h"
+
+void hl_spans_init(HlSpans *spans) {
+    spans->span = spans->inline_span;
+    spans->count = 0;
+    spans->cap = HL_SPANS_INLINE;
+}
+
+void hl_spans_free(HlSpans *spans) {
+    if (spans->span != spans->inline_span) free(spans->span);
+    hl_spans_init(spans);
+}
+
+void hl_spans_push(HlSpans *spans, int start, int len, unsigned char hl) {
+    if (len <= 0) return;
+    if (spans->count > 0) {
+        HlSpan *last = &spans->span[spans->count - 1];
+        if (last->hl == hl && last->start + last->len == start) {
+            last->len += len;
+            return;
+        }
+    }
+    if (spans->count == spans->cap) {
+        int cap = spans->cap * 2;
+        HlSpan *p = spans->span == spans->inline_span
+                  ? malloc(sizeof(HlSpan) * (size_t)cap)
+                  : realloc(spans->span, sizeof(HlSpan) * (size_t)cap);
+        if (p == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (spans->span == spans->inline_span)
+            memcpy(p, spans->inline_span, sizeof(spans->inline_span));
+        spans->span = p;
+        spans->cap = cap;
+    }
+    HlSpan *span = &spans->span[spans->count++];
+    span->start = start;
+    span->len = len;
+    span->hl = hl;
+}
+
+void hl_spans_overlay(HlSpans *spans, int start, int len, unsigned char hl) {
+    if (len <= 0) return;
+    int end = start + len;
+    HlSpans out;
+    hl_spans_init(&out);
+    int i = 0;
+    for (; i < spans->count; i++) {         /* Runs before it, or cut */
+        const HlSpan *s = &spans->span[i];
+        if (s->start >= start) break;
+        int cut = s->start + s->len < start ? s->start + s->len : start;
+        hl_spans_push(&out, s->start, cut - s->start, s->hl);
+        if (s->start + s->len > start) break;
+    }
+    hl_spans_push(&out, start, len, hl);
+    for (; i < spans->count; i++) {         /* Runs after it, or cut */
+        const HlSpan *s = &spans->span[i];
+        int from = s->start > end ? s->start : end;
+        hl_spans_push(&out, from, s->start + s->len - from, s->hl);
+    }
+    hl_spans_free(spans);
+    if (out.span == out.inline_span) {
+        memcpy(spans->inline_span, out.inline_span,
+               sizeof(HlSpan) * (size_t)out.count);
+        spans->count = out.count;
+    } else {
+        *spans = out;
+    }
+}
+
+int hl_run_end(const unsigned char *hl, int from, int limit) {
+    unsigned char v = hl[from];
+    uint64_t pattern = v * UINT64_C(0x0101010101010101);
+    int j = from + 1;
+
+    while (j + 8 <= limit) {
+        uint64_t word;
+        memcpy(&word, hl + j, sizeof(word));
+        if (word != pattern) break;
+        j += 8;
+    }
+    while (j < limit && hl[j] == v) j++;
+    return j;
+}
+
+int hl_run_count(const unsigned char *hl, int len) {
+    int count = 0;
+    for (int j = 0; j < len; j = hl_run_end(hl, j, len)) count++;
+    return count;
+}
+
+void hl_spans_from_bytes(HlSpans *spans, const unsigned char *hl,
+                         int from, int len) {
+    int limit = from + len;
+    for (int j = from; j < limit; ) {
+        int end = hl_run_end(hl, j, limit);
+        hl_spans_push(spans, j - from, end - j, hl[j]);
+        j = end;
+    }
+}
+
+/* Index of the run of 'block' holding column 'col', or count if none. */
+static int block_find(const HlSpanBlock *block, int col) {
+    int lo = 0, hi = block->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const HlSpan *s = &block->span[mid];
+        if (col < s->start) hi = mid;
+        else if (col >= s->start + s->len) lo = mid + 1;
+        else return mid;
+    }
+    return block->count;
+}
+
+void hl_spans_from_block(HlSpans *spans, const HlSpanBlock *block,
+                         int from, int len) {
+    int limit = from + len;
+    for (int i = block_find(block, from); i < block->count; i++) {
+        const HlSpan *s = &block->span[i];
+        if (s->start >= limit) break;
+        int start = s->start > from ? s->start : from;
+        int end = s->start + s->len < limit ? s->start + s->len : limit;
+        hl_spans_push(spans, start - from, end - start, s->hl);
+    }
+}
+
+HlSpanBlock *hl_span_block_pack(const unsigned char *hl, int len, int count) {
+    HlSpanBlock *block = mem_malloc(MEM_TAG_SYNTAX, HL_SPAN_BLOCK_SIZE(count));
+    if (block == NULL) return NULL;
+
+    int n = 0;
+    for (int j = 0; j < len && n < count; n++) {
+        int end = hl_run_end(hl, j, len);
+        block->span[n].start = j;
+        block->span[n].len = end - j;
+        block->span[n].hl = hl[j];
+        j = end;
+    }
+    block->count = n;
+    return block;
+}
+
+void hl_span_block_unpack(const HlSpanBlock *block, int from, int len,
+                          unsigned char *out) {
+    int limit = from + len;
+    int j = from;
+    for (int i = block_find(block, from); i < block->count && j < limit; i++) {
+        const HlSpan *s = &block->span[i];
+        int end = s->start + s->len < limit ? s->start + s->len : limit;
+        if (end > j) {
+            memset(out + (j - from), s->hl, (size_t)(end - j));
+            j = end;
+        }
+    }
+    if (j < limit) memset(out + (j - from), 0 /* HL_NORMAL */, (size_t)(limit - j));
+}
+
+unsigned char hl_span_block_at(const HlSpanBlock *block, int col) {
+    int i = block_find(block, col);
+    return i < block->count ? block->span[i].hl : 0 /* HL_NORMAL */;
+}
@@ -0,0 +1,80 @@
+/* hl_spans.h - Run-length encoded syntax highlight
+ *
+ * Highlighters write one HL_* byte per render column, but most of a row
+ * is runs of one value: plain text, comments, strings. An HlSpan is such
+ * a run. Rows keep a settled highlight as an HlSpanBlock when that is
+ * smaller than the bytes (editor_row_pack_hl()), and drawing walks the
+ * runs of a row rather than its bytes (editor_row_hl_spans()).
+ *
+ * HlSpans collects runs for one pass, with room for HL_SPANS_INLINE of
+ * them in the struct itself, so that a row of a few runs is walked
+ * without touching the heap.
+ */
+
+#ifndef LOKI_HL_SPANS_H
+#define LOKI_HL_SPANS_H
+
+/* Render columns [start, start+len) highlighted 'hl' */
+typedef struct HlSpan {
+    int start;
+    int len;
+    unsigned char hl;
+} HlSpan;
+
+/* A row's packed highlight: 'count' runs covering it in order */
+typedef struct HlSpanBlock {
+    int count;
+    HlSpan span[];
+} HlSpanBlock;
+
+#define HL_SPANS_INLINE 16
+
+typedef struct HlSpans {
+    HlSpan *span;       /* inline_span, or a heap array past it */
+    int count;
+    int cap;
+    HlSpan inline_span[HL_SPANS_INLINE];
+} HlSpans;
+
+void hl_spans_init(HlSpans *spans);
+void hl_spans_free(HlSpans *spans);
+
+/* Append a run, merged into the last one if it continues it. */
+void hl_spans_push(HlSpans *spans, int start, int len, unsigned char hl);
+
+/* Index of the first byte at or after 'from' and before 'limit' that
+ * differs from hl[from], or 'limit'. Compares a word at a time. */
+int hl_run_end(const unsigned char *hl, int from, int limit);
+
+/* Highlight columns [start, start+len) 'hl' over the runs collected,
+ * splitting those it covers part of. */
+void hl_spans_overlay(HlSpans *spans, int start, int len, unsigned char hl);
+
+/* Number of runs in hl[0, len). */
+int hl_run_count(const unsigned char *hl, int len);
+
+/* Append the runs of hl[from, from+len), with starts relative to 'from'. */
+void hl_spans_from_bytes(HlSpans *spans, const unsigned char *hl,
+                         int from, int len);
+
+/* Append the runs of 'block' over columns [from, from+len), clipped to
+ * them and with starts relative to 'from'. */
+void hl_spans_from_block(HlSpans *spans, const HlSpanBlock *block,
+                         int from, int len);
+
+/* Encode hl[0, len), which has 'count' runs (see hl_run_count()), into a
+ * malloc'd block. Returns NULL on out of memory. */
+HlSpanBlock *hl_span_block_pack(const unsigned char *hl, int len, int count);
+
+/* Bytes of the block for 'count' runs. */
+#define HL_SPAN_BLOCK_SIZE(count) \
+    (sizeof(HlSpanBlock) + (size_t)(count) * sizeof(HlSpan))
+
+/* Write columns [from, from+len) of 'block' as bytes to 'out'. */
+void hl_span_block_unpack(const HlSpanBlock *block, int from, int len,
+                          unsigned char *out);
+
+/* Highlight of column 'col' (HL_NORMAL past the last run). */
+unsigned char hl_span_block_at(const HlSpanBlock *block, int col);
+
+#endif /* LOKI_HL_SPANS_H */
@@ -7,15 +7,25 @@
  */
 
 #include "host.h"
+#include "internal.h"
+#include "syntax.h"
 #include "terminal.h"
 #include "event.h"
 #include "buffers.h"
 #include "lang_bridge.h"
 #include "live_loop.h"
 #include "async_queue.h"
+#include "frame_pacer.h"
+#include "lua_gc.h"
+#include "event_loop.h"
+#include "recovery.h"
+#include "preview.h"
+#include "idle.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <uv.h>
 
 /* ======================= Common Host Logic ================================= */
 
@@ -54,31 +64,63 @@ int editor_host_loop(EditorHost *host, EditorSession *session) {
     if (!host || !session) return -1;
 
     EditorEvent event;
+    FramePacer pacer;
+    frame_pacer_init(&pacer);
 
     while (host->should_continue && host->should_continue(host)) {
-        /* Render current state */
-        if (host->render) {
+        /* Render current state, at most once per frame and only if changed */
+        editor_ctx_t *ctx = editor_session_get_ctx(session);
+        if (ctx) frame_pacer_note_state(&pacer, editor_screen_stamp(ctx));
+        uint64_t now = uv_hrtime();
+        if (host->render && frame_pacer_ready(&pacer, now)) {
             host->render(host, session);
+            frame_pacer_drawn(&pacer, now, ctx ? editor_screen_stamp(ctx) : 0);
+            /* Highlighting ran out of time: keep going next frame */
+            if (ctx && syntax_pending(ctx)) frame_pacer_damage(&pacer);
         }
 
-        /* Read next event */
-        int read_result = host->read_event(host, &event, 100); /* 100ms timeout */
+        /* Idle tasks get part of the time to the next frame */
+        if (idle_pending() &&
+            idle_run(idle_budget(frame_pacer_timeout(&pacer, uv_hrtime()))))
+            frame_pacer_damage(&pacer);
+
+        /* Read next event, waiting no longer than the next frame is due */
+        int timeout = frame_pacer_timeout(&pacer, uv_hrtime());
+        int due = recovery_tick(uv_hrtime());
+        if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due;
+        due = preview_tick(uv_hrtime());
+        if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due;
+        if (idle_pending()) timeout = 0;  /* Idle work left */
+        if (ctx && timeout != 0) {
+            /* Idle until then: the Lua collector's turn (see editor.c) */
+            uint64_t budget = timeout > 0 ? (uint64_t)timeout * 500000 : 0;
+            if (budget > LUA_GC_IDLE_BUDGET_NS) budget = 0;
+            lua_gc_idle(ctx_L(ctx), budget);
+        }
+        if (host->read_event(host, &event, timeout) != 0) {
+            /* Timeout or error - continue loop for render/resize handling */
+            continue;
+        }
 
-        if (read_result == 0) {
-            /* Process event */
+        /* Process everything already queued before drawing again */
+        uint64_t burst = uv_hrtime();
+        do {
+            if (ctx) lua_gc_input(ctx_L(ctx));
             int handle_result = editor_session_handle_event(session, &event);
 
             if (handle_result == 1) {
                 /* Quit requested */
                 return 0;
             }
+            frame_pacer_damage(&pacer);
 
             /* Notify tick */
             if (host->callbacks.on_tick) {
                 host->callbacks.on_tick(host, session);
             }
-        }
-        /* Timeout or error - continue loop for render/resize handling */
+        } while (frame_pacer_within_frame(burst, uv_hrtime()) &&
+                 host->should_continue(host) &&
+                 host->read_event(host, &event, 0) == 0);
     }
 
     return 0;
@@ -94,7 +136,6 @@ typedef struct {
 
 static int terminal_host_read_event(EditorHost *host, EditorEvent *event, int timeout_ms) {
     TerminalHostData *data = (TerminalHostData *)host->data;
-    (void)timeout_ms; /* terminal_read_key has its own timeout */
 
     /* Check for resize */
     if (terminal_host_resize_pending(&data->terminal)) {
@@ -109,12 +150,13 @@ static int terminal_host_read_event(EditorHost *host, EditorEvent *event, int ti
     }
 
     /* Read key */
-    int key = terminal_read_key(data->input_fd);
-    if (key == -1) {
-        return 1; /* Timeout */
+    int ready = event_loop_active()
+        ? (event_loop_wait(timeout_ms) & EVENT_LOOP_INPUT) != 0
+        : terminal_wait_input(data->input_fd, timeout_ms) > 0;
+    if (!ready) {
+        return 1; /* Timeout, or woken for a resize */
     }
-
-    *event = event_from_keycode(key);
+    *event = event_read_terminal(data->input_fd);
     return 0;
 }
 
@@ -122,13 +164,12 @@ static void terminal_host_render(EditorHost *host, EditorSession *session) {
     (void)host;
 
     /* Get view model and render */
-    EditorViewModel *vm = editor_session_snapshot(session);
+    const EditorViewModel *vm = editor_session_frame(session);
     if (!vm) return;
 
     /* For now, we still use the legacy rendering path through
      * buffer_get_current() and editor_refresh_screen().
      * TODO: Use vm directly with a renderer */
-    editor_viewmodel_free(vm);
 
     /* Use buffer system's refresh */
     editor_ctx_t *ctx = buffer_get_current();
@@ -147,6 +188,7 @@ static void terminal_host_destroy(EditorHost *host) {
 
     TerminalHostData *data = (TerminalHostData *)host->data;
     if (data) {
+        event_loop_cleanup();
         terminal_host_disable_raw_mode(&data->terminal);
         terminal_host_cleanup(&data->terminal);
         free(data);
@@ -167,6 +209,9 @@ EditorHost *editor_host_terminal_create(int input_fd) {
     data->input_fd = input_fd;
     data->running = 1;
 
+    /* Keystroke latency tracing, if LOKI_TRACE names a file */
+    trace_start_from_env();
+
     /* Initialize terminal */
     if (terminal_host_init(&data->terminal, input_fd) != 0) {
         free(data);
@@ -181,6 +226,9 @@ EditorHost *editor_host_terminal_create(int input_fd) {
         return NULL;
     }
 
+    /* Sleep on the libuv loop; without it read_event polls stdin */
+    event_loop_init(input_fd);
+
     host->read_event = terminal_host_read_event;
     host->render = terminal_host_render;
     host->should_continue = terminal_host_should_continue;
@@ -60,7 +60,8 @@ struct EditorHost {
      * Timeout of -1 means block indefinitely. */
     int (*read_event)(EditorHost *host, EditorEvent *event, int timeout_ms);
 
-    /* Render current state. Called after each event.
+    /* Render current state. Called once pending events are handled, at
+     * most once per frame and only when the state changed (frame_pacer.h).
      * Implementation depends on host type (terminal, HTTP response, etc.) */
     void (*render)(EditorHost *host, EditorSession *session);
 
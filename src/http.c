@@ -1,48 +1,198 @@
 /* http.c - Async HTTP support for Loki
  *
  * Implementation of asynchronous HTTP requests using libcurl.
+ *
+ * All transfers share one multi handle driven by the libuv loop the
+ * editor waits on: curl says through its socket callback which sockets
+ * to watch, and each gets a uv_poll_t; its timer callback arms one
+ * uv_timer_t. Transfers only run when a socket is ready or curl's
+ * timeout passes, so requests waiting on the network cost nothing, and
+ * the multi handle keeps connections for the next request to the same
+ * host. Completed transfers are handed to Lua by loki_http_poll().
+ *
+ * Repeat requests to one endpoint (AI completions) should not pay for a
+ * DNS lookup, TCP connect and TLS handshake each time. Easy handles
+ * are kept for reuse when their transfer is done. A share handle holds
+ * the DNS cache and TLS sessions across them, so a connection that did
+ * close can still resume its session. HTTP/2, where curl supports it,
+ * multiplexes concurrent requests over one connection, and
+ * loki_http_preconnect() can open that connection before it is needed.
+ *
+ * A streaming request hands its body over as it arrives, not at the
+ * end: each piece curl writes, or each server-sent event's data, goes
+ * through the async queue as an HTTP_CHUNK_ASYNC_EVENT to the request's
+ * chunk function. When the queue is full the transfer is paused until
+ * the chunks queued have been handled, so none are dropped, and the
+ * final callback comes after the last of them.
+ *
+ * Requests that opt in (GET, or POST with a key of their own) go
+ * through a response cache: an LRU of responses bounded in bytes, kept
+ * on disk in ~/.loki/cache as well. A fresh entry answers a request at
+ * once, without the network. A stale one that has a validator (ETag,
+ * Last-Modified) is revalidated with a conditional request, and a 304
+ * answers it from the entry. Freshness is what Cache-Control (max-age,
+ * no-cache, no-store) or Expires say, else the request's own TTL.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "http.h"
 #include "internal.h"
+#include "loki.h"
+#include "event_loop.h"
+#include "async_queue.h"
+#include "lua_profile.h"
+#include "memstats.h"
+#include "startup.h"
 #include <lua.h>
 #include <lauxlib.h>
 #include <curl/curl.h>
+#include <uv.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef LOKI_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /* Response data structure */
 typedef struct {
     char *data;
     size_t size;
+    size_t capacity;            /* Bytes allocated, with the NUL */
+    CURL *easy;                 /* Transfer whose Content-Length sizes the
+                                   first allocation, or NULL */
 } http_response_t;
 
+#define RESPONSE_MIN_CAPACITY 1024
+
+/* What a response's headers say about caching it */
+typedef struct {
+    long max_age;               /* -1: not given */
+    int no_store, no_cache;
+    time_t expires;             /* Expires header, 0 if none; 1 if invalid */
+    char etag[256];
+    char last_modified[64];
+} http_cache_headers_t;
+
+/* A Lua function to call back: held by registry reference (ref > 0), or
+ * looked up by its global name when the response comes */
+typedef struct {
+    char *name;
+    int ref;
+} http_callback_t;
+
 /* Async request tracking */
 typedef struct {
-    CURLM *multi_handle;
     CURL *easy_handle;
     http_response_t response;
-    char *lua_callback;
+    http_callback_t callback;
+    lua_State *callback_L;      /* Holds the references, once submitted */
     struct curl_slist *header_list;
     int completed;
     int failed;
+    int preconnect;             /* Warm-up: no response wanted */
     char error_buffer[CURL_ERROR_SIZE];
+
+    /* Streaming (on_chunk set) */
+    int id;                     /* Its slot */
+    uint32_t serial;            /* Tells chunk events of a reused slot */
+    editor_ctx_t *ctx;
+    loki_http_stream_mode_t mode;
+    loki_http_chunk_fn on_chunk;
+    void *chunk_data;
+    http_response_t sse;        /* Bytes not yet parsed into events */
+    int chunks_queued;          /* Chunk events not yet handled */
+    int blocked;                /* A chunk could not be queued */
+    int paused;                 /* Transfer paused on a full queue */
+
+    /* Superseding, debouncing and coalescing */
+    char *key;                  /* A newer request with it cancels this */
+    int waiting;                /* Debounced: not sent before send_at */
+    uint64_t send_at;           /* uv_now() milliseconds */
+    int coalesce;
+    uint64_t signature;         /* Of what is sent, to tell identical ones */
+    http_callback_t *joined;    /* Callbacks of requests that joined it */
+    int njoined;
+
+    /* Caching (cache_key set) */
+    char *cache_key;
+    long cache_ttl;             /* Seconds fresh when the headers don't say */
+    http_cache_headers_t cache_headers;
 } async_http_request_t;
 
+/* Body of an HTTP_CHUNK_ASYNC_EVENT payload */
+typedef struct {
+    size_t len;
+    char data[];                /* NUL-terminated */
+} http_chunk_t;
+
+/* A socket curl wants watched */
+typedef struct http_socket {
+    uv_poll_t poll;
+    curl_socket_t fd;
+    struct http_socket *next;
+} http_socket_t;
+
 /* Module state */
 static async_http_request_t *pending_requests[LOKI_HTTP_MAX_ASYNC_REQUESTS] = {0};
 static int num_pending = 0;
 static int curl_initialized = 0;
 
+/* Shared multi handle and the libuv handles driving it */
+static CURLM *multi = NULL;
+static uv_timer_t multi_timer;
+static uv_timer_t delay_timer;         /* Sends debounced requests */
+static http_socket_t *sockets = NULL;
+
+/* DNS cache and TLS sessions shared by every easy handle */
+static CURLSH *share = NULL;
+
+/* Easy handles kept from finished transfers */
+static CURL *idle_handles[LOKI_HTTP_MAX_ASYNC_REQUESTS];
+static int num_idle = 0;
+
+static uint32_t next_serial = 0;
+
+/* Timings totalled, over all transfers and per host */
+static loki_http_stats_t stats_all;
+static struct {
+    char name[64];
+    loki_http_stats_t stats;
+} stats_hosts[LOKI_HTTP_STATS_HOSTS];
+static int stats_nhosts = 0;
+
 /* Rate limiting state */
 static time_t rate_limit_window_start = 0;
 static int rate_limit_count = 0;
 
 /* ======================= Internal Functions ======================= */
 
+/* Make room for 'len' bytes and the NUL. Capacity doubles, so a large
+ * body is copied O(1) times per byte, up to the response size limit.
+ * Returns 0, or -1 out of memory. */
+static int response_reserve(http_response_t *resp, size_t len) {
+    if (len + 1 <= resp->capacity) return 0;
+    size_t cap = resp->capacity < RESPONSE_MIN_CAPACITY ? RESPONSE_MIN_CAPACITY : resp->capacity;
+    while (cap < len + 1) cap *= 2;
+    if (cap > LOKI_HTTP_MAX_RESPONSE_SIZE + 1) cap = LOKI_HTTP_MAX_RESPONSE_SIZE + 1;
+
+    char *ptr = mem_realloc(MEM_TAG_HTTP, resp->data, cap);
+    if (!ptr) return -1;
+    resp->data = ptr;
+    resp->capacity = cap;
+    return 0;
+}
+
 /* Curl write callback */
 static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
@@ -53,12 +203,20 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
         return 0;  /* Abort - response too large */
     }
 
-    char *ptr = realloc(resp->data, resp->size + realsize + 1);
-    if (!ptr) {
+    /* The whole body in one allocation when the server says its size */
+    if (resp->size == 0 && resp->easy) {
+        curl_off_t length = -1;
+        if (curl_easy_getinfo(resp->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK &&
+            length > 0 && length <= LOKI_HTTP_MAX_RESPONSE_SIZE &&
+            response_reserve(resp, (size_t)length) != 0) {
+            return 0;  /* Out of memory */
+        }
+    }
+
+    if (response_reserve(resp, resp->size + realsize) != 0) {
         return 0;  /* Out of memory */
     }
 
-    resp->data = ptr;
     memcpy(&(resp->data[resp->size]), contents, realsize);
     resp->size += realsize;
     resp->data[resp->size] = '\0';
@@ -66,8 +224,11 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
     return realsize;
 }
 
-/* Detect CA bundle path */
+/* Detect CA bundle path, once: the files are not looked for again on
+ * every request */
 static const char *detect_ca_bundle_path(void) {
+    static int detected = 0;
+    static const char *found = NULL;
     static const char *ca_paths[] = {
         "/etc/ssl/cert.pem",                      /* macOS */
         "/etc/ssl/certs/ca-certificates.crt",     /* Debian/Ubuntu */
@@ -78,13 +239,30 @@ static const char *detect_ca_bundle_path(void) {
         NULL
     };
 
+    if (detected) return found;
+    detected = 1;
     for (int i = 0; ca_paths[i] != NULL; i++) {
         if (access(ca_paths[i], R_OK) == 0) {
-            return ca_paths[i];
+            found = ca_paths[i];
+            break;
         }
     }
+    return found;
+}
 
-    return NULL;
+/* Whether 'url' is on this machine: localhost, 127.x.x.x or [::1] */
+static int url_is_local(const char *url) {
+    const char *host = strstr(url, "://");
+    if (!host) return 0;
+    host += 3;
+    if (host[0] == '[') return strncmp(host, "[::1]", 5) == 0;
+    size_t len = strcspn(host, ":/?#");
+    if (len == 9 && strncasecmp(host, "localhost", 9) == 0) return 1;
+    if (len < 7 || strncmp(host, "127.", 4) != 0) return 0;
+    for (size_t i = 4; i < len; i++) {
+        if (!isdigit((unsigned char)host[i]) && host[i] != '.') return 0;
+    }
+    return 1;
 }
 
 /* Check rate limiting */
@@ -106,12 +284,937 @@ static int check_rate_limit(void) {
     return 1;
 }
 
+static void on_chunk_event(AsyncEvent *event, void *ctx);
+
+/* Hand a chunk to the request's chunk function through the async queue
+ * (or directly without one). Returns 0, or -1 if the queue is full. */
+static int deliver_chunk(async_http_request_t *req, const char *data, size_t len) {
+    http_chunk_t *chunk = async_payload_alloc(sizeof(http_chunk_t) + len + 1);
+    if (!chunk) return -1;
+    chunk->len = len;
+    memcpy(chunk->data, data, len);
+    chunk->data[len] = '\0';
+
+    if (!async_queue_global()) {
+        req->on_chunk(req->ctx, req->id, chunk->data, len, req->chunk_data);
+        async_payload_release(chunk);
+        return 0;
+    }
+
+    if (async_queue_get_handler(NULL, HTTP_CHUNK_ASYNC_EVENT) != on_chunk_event) {
+        async_queue_set_handler_lane(NULL, HTTP_CHUNK_ASYNC_EVENT, on_chunk_event,
+                                     ASYNC_LANE_HIGH);
+        async_event_set_type_name(HTTP_CHUNK_ASYNC_EVENT, "http");
+    }
+
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = HTTP_CHUNK_ASYNC_EVENT;
+    ev.flags = ASYNC_FLAG_PAYLOAD;
+    ev.heap_data = chunk;
+    ev.data.user.i64[0] = req->id;
+    ev.data.user.i64[1] = req->serial;
+    if (async_queue_push(NULL, &ev) != 0) {
+        async_payload_release(chunk);
+        return -1;
+    }
+    req->chunks_queued++;
+    return 0;
+}
+
+static void on_chunk_event(AsyncEvent *event, void *ctx) {
+    int64_t id = event->data.user.i64[0];
+    if (id < 0 || id >= LOKI_HTTP_MAX_ASYNC_REQUESTS) return;
+    async_http_request_t *req = pending_requests[id];
+    if (!req || req->serial != (uint32_t)event->data.user.i64[1]) return;
+
+    const http_chunk_t *chunk = event->heap_data;
+    req->chunks_queued--;
+    req->on_chunk(ctx, req->id, chunk->data, chunk->len, req->chunk_data);
+}
+
+/* One line of an event stream, without its line ending */
+static int sse_field(const char *line, size_t len, const char *name,
+                     const char **value, size_t *value_len) {
+    size_t n = strlen(name);
+    if (len < n + 1 || memcmp(line, name, n) != 0 || line[n] != ':') return 0;
+    *value = line + n + 1;
+    *value_len = len - n - 1;
+    if (*value_len > 0 && **value == ' ') {
+        (*value)++;
+        (*value_len)--;
+    }
+    return 1;
+}
+
+/* Deliver the complete events buffered: the data lines of each, joined
+ * with newlines (events without data are skipped). Stops at one the
+ * queue refuses, leaving it buffered, and sets req->blocked. */
+static void flush_sse(async_http_request_t *req) {
+    http_response_t *buf = &req->sse;
+    size_t start = 0;
+    req->blocked = 0;
+
+    while (start < buf->size) {
+        /* Find the blank line ending the event */
+        size_t line = start, end = 0;
+        int found = 0;
+        for (size_t i = start; i < buf->size; i++) {
+            if (buf->data[i] != '\n') continue;
+            size_t len = i - line;
+            if (len > 0 && buf->data[i - 1] == '\r') len--;
+            if (len == 0) {
+                end = i + 1;
+                found = 1;
+                break;
+            }
+            line = i + 1;
+        }
+        if (!found) break;
+
+        /* Join its data lines */
+        char *data = NULL;
+        size_t data_len = 0;
+        int has_data = 0;
+        for (size_t ls = start; ls < end;) {
+            const char *nl = memchr(buf->data + ls, '\n', end - ls);
+            size_t len = (size_t)(nl - (buf->data + ls));
+            if (len > 0 && buf->data[ls + len - 1] == '\r') len--;
+            const char *value;
+            size_t value_len;
+            if (sse_field(buf->data + ls, len, "data", &value, &value_len)) {
+                char *grown = realloc(data, data_len + value_len + 1);
+                if (!grown) {
+                    perror("Out of memory");
+                    exit(1);
+                }
+                data = grown;
+                if (has_data) data[data_len++] = '\n';
+                memcpy(data + data_len, value, value_len);
+                data_len += value_len;
+                has_data = 1;
+            }
+            ls = (size_t)(nl - buf->data) + 1;
+        }
+
+        int ok = !has_data || deliver_chunk(req, data, data_len) == 0;
+        free(data);
+        if (!ok) {
+            req->blocked = 1;
+            break;
+        }
+        start = end;
+    }
+
+    if (start > 0) {
+        memmove(buf->data, buf->data + start, buf->size - start);
+        buf->size -= start;
+        buf->data[buf->size] = '\0';
+    }
+}
+
+/* Curl write callback of a streaming request */
+static size_t stream_write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    async_http_request_t *req = (async_http_request_t *)userp;
+
+    /* An error response is kept whole, for the final callback */
+    long status = 0;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 400) return write_callback(contents, size, nmemb, &req->response);
+
+    if (req->mode == LOKI_HTTP_STREAM_RAW) {
+        if (deliver_chunk(req, contents, realsize) != 0) {
+            req->paused = 1;
+            return CURL_WRITEFUNC_PAUSE;    /* curl writes it again */
+        }
+        return realsize;
+    }
+
+    /* Events the queue refused go first; until they do, take no more */
+    if (req->blocked) flush_sse(req);
+    if (req->blocked) {
+        req->paused = 1;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (write_callback(contents, size, nmemb, &req->sse) != realsize) return 0;
+    flush_sse(req);
+    return realsize;
+}
+
+/* Whether a streaming request's chunks have all been handled; resumes
+ * its transfer once the queue has room again */
+static int stream_caught_up(async_http_request_t *req) {
+    if (req->mode == LOKI_HTTP_STREAM_SSE && req->blocked) flush_sse(req);
+    if (req->paused && !req->blocked && req->chunks_queued == 0) {
+        req->paused = 0;
+        curl_easy_pause(req->easy_handle, CURLPAUSE_CONT);
+    }
+    return !req->blocked && req->chunks_queued == 0;
+}
+
+/* An easy handle with no options set, reused if one is idle */
+static CURL *acquire_handle(void) {
+    if (num_idle > 0) {
+        CURL *easy = idle_handles[--num_idle];
+        curl_easy_reset(easy);  /* Keeps its connections and caches */
+        return easy;
+    }
+    return curl_easy_init();
+}
+
+static void release_handle(CURL *easy) {
+    if (num_idle < LOKI_HTTP_MAX_ASYNC_REQUESTS) idle_handles[num_idle++] = easy;
+    else curl_easy_cleanup(easy);
+}
+
+/* Let go of a callback; its reference only if 'L' is given */
+static void drop_callback(lua_State *L, http_callback_t *cb) {
+    if (L && cb->ref > 0) luaL_unref(L, LUA_REGISTRYINDEX, cb->ref);
+    cb->ref = 0;
+    free(cb->name);
+    cb->name = NULL;
+}
+
+static void free_request(async_http_request_t *req) {
+    release_handle(req->easy_handle);
+    if (req->header_list) {
+        curl_slist_free_all(req->header_list);
+    }
+    mem_free(MEM_TAG_HTTP, req->response.data);
+    mem_free(MEM_TAG_HTTP, req->sse.data);
+    drop_callback(req->callback_L, &req->callback);
+    free(req->cache_key);
+    free(req->key);
+    for (int i = 0; i < req->njoined; i++) drop_callback(req->callback_L, &req->joined[i]);
+    free(req->joined);
+    free(req);
+}
+
+/* Mark the transfers curl has finished as completed */
+static void collect_completed(void) {
+    int msgs_left = 0;
+    CURLMsg *msg = NULL;
+
+    while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        async_http_request_t *req = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+        if (!req) continue;
+        if (msg->data.result != CURLE_OK) {
+            req->failed = 1;
+            if (req->error_buffer[0] == '\0') {
+                snprintf(req->error_buffer, CURL_ERROR_SIZE, "%s",
+                         curl_easy_strerror(msg->data.result));
+            }
+        }
+        curl_multi_remove_handle(multi, req->easy_handle);
+        req->completed = 1;
+    }
+}
+
+static void on_socket_close(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void close_socket(http_socket_t *sock) {
+    for (http_socket_t **p = &sockets; *p; p = &(*p)->next) {
+        if (*p == sock) {
+            *p = sock->next;
+            break;
+        }
+    }
+    uv_poll_stop(&sock->poll);
+    uv_close((uv_handle_t *)&sock->poll, on_socket_close);
+}
+
+static void on_socket_ready(uv_poll_t *handle, int status, int events) {
+    http_socket_t *sock = handle->data;
+    int flags = 0;
+    if (status < 0) flags = CURL_CSELECT_ERR;
+    if (events & UV_READABLE) flags |= CURL_CSELECT_IN;
+    if (events & UV_WRITABLE) flags |= CURL_CSELECT_OUT;
+
+    int running = 0;
+    curl_multi_socket_action(multi, sock->fd, flags, &running);
+    collect_completed();
+}
+
+static void on_multi_timeout(uv_timer_t *handle) {
+    (void)handle;
+    int running = 0;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    collect_completed();
+}
+
+/* CURLMOPT_SOCKETFUNCTION: watch 'fd' for what curl asks */
+static int socket_callback(CURL *easy, curl_socket_t fd, int what,
+                           void *userp, void *socketp) {
+    (void)easy;
+    (void)userp;
+    http_socket_t *sock = socketp;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (sock) {
+            close_socket(sock);
+            curl_multi_assign(multi, fd, NULL);
+        }
+        return 0;
+    }
+
+    if (!sock) {
+        sock = malloc(sizeof(*sock));
+        if (!sock) return -1;
+        if (uv_poll_init_socket(uv_default_loop(), &sock->poll, fd) != 0) {
+            free(sock);
+            return -1;
+        }
+        sock->fd = fd;
+        sock->poll.data = sock;
+        sock->next = sockets;
+        sockets = sock;
+        curl_multi_assign(multi, fd, sock);
+    }
+
+    int events = 0;
+    if (what & CURL_POLL_IN) events |= UV_READABLE;
+    if (what & CURL_POLL_OUT) events |= UV_WRITABLE;
+    uv_poll_start(&sock->poll, events, on_socket_ready);
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: have the loop call curl back after
+ * 'timeout_ms' (-1: no timeout) */
+static int timer_callback(CURLM *m, long timeout_ms, void *userp) {
+    (void)m;
+    (void)userp;
+    if (timeout_ms < 0) uv_timer_stop(&multi_timer);
+    else uv_timer_start(&multi_timer, on_multi_timeout, (uint64_t)timeout_ms, 0);
+    return 0;
+}
+
+/* Create the shared multi handle. Returns 0, or -1 on failure. */
+static int multi_start(void) {
+    if (multi) return 0;
+    if (uv_timer_init(uv_default_loop(), &multi_timer) != 0) return -1;
+    if (uv_timer_init(uv_default_loop(), &delay_timer) != 0) {
+        uv_close((uv_handle_t *)&multi_timer, NULL);
+        return -1;
+    }
+    multi = curl_multi_init();
+    if (!multi) {
+        uv_close((uv_handle_t *)&multi_timer, NULL);
+        uv_close((uv_handle_t *)&delay_timer, NULL);
+        return -1;
+    }
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    /* Only the main thread uses the share, so it needs no locks */
+    share = curl_share_init();
+    if (share) {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    return 0;
+}
+
+/* Options every transfer has; 'unix_socket' (or NULL) is a socket to
+ * connect through instead of the URL's host */
+static void setup_handle(async_http_request_t *req, const char *url,
+                         const char *unix_socket) {
+    CURL *easy = req->easy_handle;
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &req->response);
+    curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, req->error_buffer);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, (long)LOKI_HTTP_TIMEOUT);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, (long)LOKI_HTTP_CONNECT_TIMEOUT);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+
+    /* Offer every encoding curl can decode; bodies (and streamed chunks)
+     * reach us decoded, and the size limit applies to them decoded */
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+
+    /* Connection reuse: shared caches, idle connections kept alive, and
+     * HTTP/2 where curl has it, with a transfer to a host that is still
+     * connecting waiting to multiplex rather than opening another */
+    if (share) curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    /* A local model server (loopback, or a Unix socket) is one hop away:
+     * no proxy from the environment, and its connection kept open across
+     * the pauses between completions rather than reconnected each time.
+     * It speaks HTTP/1.1, so there is nothing to multiplex. */
+    if (unix_socket) {
+#if LIBCURL_VERSION_NUM >= 0x072800
+        curl_easy_setopt(easy, CURLOPT_UNIX_SOCKET_PATH, unix_socket);
+#endif
+    }
+    if (unix_socket || url_is_local(url)) {
+        curl_easy_setopt(easy, CURLOPT_NOPROXY, "*");
+        curl_easy_setopt(easy, CURLOPT_TCP_NODELAY, 1L);
+#if LIBCURL_VERSION_NUM >= 0x074100
+        curl_easy_setopt(easy, CURLOPT_MAXAGE_CONN, (long)LOKI_HTTP_LOCAL_MAXAGE);
+#endif
+    } else if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2) {
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    /* SSL/TLS settings, for https:// only */
+    if (strncmp(url, "https://", 8) == 0) {
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 1L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 2L);
+
+        const char *ca_bundle = detect_ca_bundle_path();
+        if (ca_bundle) {
+            curl_easy_setopt(easy, CURLOPT_CAINFO, ca_bundle);
+        }
+    }
+
+    /* Debug mode */
+    if (getenv("LOKI_DEBUG")) {
+        curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+    }
+}
+
+#ifdef LOKI_HAVE_ZLIB
+/* A body gzipped, or NULL if it doesn't get smaller */
+static unsigned char *gzip_body(const char *body, size_t len, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    uLong bound = deflateBound(&zs, (uLong)len);
+    unsigned char *out = malloc(bound);
+    if (!out) {
+        perror("Out of memory");
+        exit(1);
+    }
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)bound;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || *out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+/* Send a POST body gzipped if it is long enough and the caller hasn't
+ * encoded it; falls back to the body as it is */
+static void set_post_body(async_http_request_t *req, const char *body, size_t compress_min) {
+    size_t len = strlen(body);
+#ifdef LOKI_HAVE_ZLIB
+    int encoded = 0;
+    for (struct curl_slist *h = req->header_list; h; h = h->next) {
+        if (strncasecmp(h->data, "Content-Encoding:", 17) == 0) encoded = 1;
+    }
+    size_t zlen;
+    unsigned char *z = compress_min && len >= compress_min && !encoded
+                       ? gzip_body(body, len, &zlen) : NULL;
+    if (z) {
+        curl_easy_setopt(req->easy_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)zlen);
+        curl_easy_setopt(req->easy_handle, CURLOPT_COPYPOSTFIELDS, z);
+        free(z);
+        req->header_list = curl_slist_append(req->header_list, "Content-Encoding: gzip");
+        return;
+    }
+#else
+    (void)compress_min;
+#endif
+    /* Copied: the caller's string need not outlive the call */
+    curl_easy_setopt(req->easy_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+    curl_easy_setopt(req->easy_handle, CURLOPT_COPYPOSTFIELDS, body);
+}
+
+/* A free request slot, or -1 */
+static int free_slot(void) {
+    if (num_pending >= LOKI_HTTP_MAX_ASYNC_REQUESTS) return -1;
+    for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+        if (!pending_requests[i]) return i;
+    }
+    return -1;
+}
+
+/* A request with an easy handle, response buffer and the multi handle
+ * ready, connecting through 'unix_socket' if not NULL; NULL on failure */
+static async_http_request_t *new_request(const char *url, const char *unix_socket) {
+    loki_http_init();
+    if (multi_start() != 0) return NULL;
+
+    async_http_request_t *req = calloc(1, sizeof(async_http_request_t));
+    if (!req) return NULL;
+    req->response.data = mem_malloc(MEM_TAG_HTTP, 1);
+    if (!req->response.data) {
+        free(req);
+        return NULL;
+    }
+    req->response.data[0] = '\0';
+    req->response.capacity = 1;
+    req->easy_handle = acquire_handle();
+    if (!req->easy_handle) {
+        mem_free(MEM_TAG_HTTP, req->response.data);
+        free(req);
+        return NULL;
+    }
+    req->response.easy = req->easy_handle;
+    setup_handle(req, url, unix_socket);
+    return req;
+}
+
+/* Start a request's transfer and take its slot. Returns 0, or -1 (the
+ * request is freed). */
+static int submit_request(async_http_request_t *req, int slot) {
+    if (curl_multi_add_handle(multi, req->easy_handle) != CURLM_OK) {
+        free_request(req);
+        return -1;
+    }
+    pending_requests[slot] = req;
+    num_pending++;
+    return 0;
+}
+
+static void lua_chunk(editor_ctx_t *ctx, int id, const char *data, size_t len,
+                      void *userdata);
+static void push_streams_table(lua_State *L);
+
+/* Drop a pending request, stopping its transfer; it never calls back */
+static void cancel_request(int id) {
+    async_http_request_t *req = pending_requests[id];
+    if (!req->completed && !req->waiting) curl_multi_remove_handle(multi, req->easy_handle);
+    if (req->on_chunk == lua_chunk) {
+        lua_State *L = req->chunk_data;
+        push_streams_table(L);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, id);
+        lua_pop(L, 1);
+    }
+    free_request(req);
+    pending_requests[id] = NULL;
+    num_pending--;
+}
+
+/* Fail a request before its transfer ends; the poll reports it */
+static void fail_request(async_http_request_t *req, const char *error) {
+    snprintf(req->error_buffer, CURL_ERROR_SIZE, "%s", error);
+    req->failed = 1;
+    req->completed = 1;
+}
+
+/* Send a debounced request whose wait is over. It is only now charged
+ * to the rate limit. */
+static void send_waiting(async_http_request_t *req) {
+    req->waiting = 0;
+    if (!check_rate_limit()) {
+        fail_request(req, "Rate limit exceeded");
+    } else if (curl_multi_add_handle(multi, req->easy_handle) != CURLM_OK) {
+        fail_request(req, "Could not start the transfer");
+    }
+}
+
+static void on_delay_timer(uv_timer_t *handle);
+
+/* Have the loop wake when the next debounced request is due */
+static void arm_delay_timer(void) {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+        async_http_request_t *req = pending_requests[i];
+        if (req && req->waiting && req->send_at < next) next = req->send_at;
+    }
+    if (next == UINT64_MAX) {
+        uv_timer_stop(&delay_timer);
+        return;
+    }
+    uint64_t now = uv_now(uv_default_loop());
+    uv_timer_start(&delay_timer, on_delay_timer, next > now ? next - now : 0, 0);
+}
+
+static void on_delay_timer(uv_timer_t *handle) {
+    (void)handle;
+    uint64_t now = uv_now(uv_default_loop());
+    for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+        async_http_request_t *req = pending_requests[i];
+        if (req && req->waiting && req->send_at <= now) send_waiting(req);
+    }
+    arm_delay_timer();
+}
+
+/* What a request sends, hashed (FNV-1a), to find identical ones */
+static uint64_t hash_bytes(uint64_t h, const char *s) {
+    if (!s) s = "";
+    for (const unsigned char *p = (const unsigned char *)s; ; p++) {
+        h ^= *p;
+        h *= 1099511628211ull;
+        if (!*p) break;
+    }
+    return h;
+}
+
+static uint64_t request_signature(const char *url, const char *method, const char *body,
+                                  const char **headers, int num_headers,
+                                  const loki_http_request_opts_t *opts) {
+    uint64_t h = 1469598103934665603ull;
+    h = hash_bytes(h, method);
+    h = hash_bytes(h, url);
+    h = hash_bytes(h, body);
+    for (int i = 0; i < num_headers; i++) h = hash_bytes(h, headers[i]);
+    h = hash_bytes(h, opts->key);
+    h = hash_bytes(h, opts->unix_socket);
+    return hash_bytes(h, opts->cache_key);
+}
+
+/* ======================= Response Cache ======================= */
+
+#define CACHE_BUCKETS 256
+#define CACHE_FILE_MAGIC "LOKIHTTP 1"
+
+typedef struct http_cache_entry {
+    char *key;
+    uint64_t hash;
+    long status;
+    char *body;
+    size_t size;
+    char *etag;                 /* Validators, or NULL */
+    char *last_modified;
+    time_t expires;             /* Fresh until; 0: revalidate on each use */
+    size_t cost;                /* Bytes it holds */
+    struct http_cache_entry *newer, *older, *chain;
+} http_cache_entry_t;
+
+static struct {
+    http_cache_entry_t *buckets[CACHE_BUCKETS];
+    http_cache_entry_t *newest, *oldest;
+    size_t max_bytes;
+    int disk;
+    loki_http_cache_stats_t stats;
+} cache = { .max_bytes = LOKI_HTTP_CACHE_SIZE, .disk = 1 };
+
+static uint64_t cache_hash(const char *key) {
+    uint64_t h = 1469598103934665603ull;       /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static char *dup_or_null(const char *s) {
+    if (!s || !s[0]) return NULL;
+    char *d = strdup(s);
+    if (!d) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return d;
+}
+
+static void cache_unlink_lru(http_cache_entry_t *e) {
+    if (e->newer) e->newer->older = e->older;
+    else cache.newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else cache.oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+static void cache_push_newest(http_cache_entry_t *e) {
+    e->older = cache.newest;
+    e->newer = NULL;
+    if (cache.newest) cache.newest->newer = e;
+    cache.newest = e;
+    if (!cache.oldest) cache.oldest = e;
+}
+
+static void cache_remove(http_cache_entry_t *e) {
+    http_cache_entry_t **p = &cache.buckets[e->hash % CACHE_BUCKETS];
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+    cache_unlink_lru(e);
+    cache.stats.bytes -= e->cost;
+    cache.stats.entries--;
+    free(e->key);
+    mem_free(MEM_TAG_HTTP, e->body);
+    free(e->etag);
+    free(e->last_modified);
+    free(e);
+}
+
+/* The entry in memory for a key, made the most recent; or NULL */
+static http_cache_entry_t *cache_find(const char *key) {
+    uint64_t hash = cache_hash(key);
+    for (http_cache_entry_t *e = cache.buckets[hash % CACHE_BUCKETS]; e; e = e->chain) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            cache_unlink_lru(e);
+            cache_push_newest(e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Keep a response in memory, in place of any entry for its key, making
+ * room by dropping the least recently used. Takes 'body' (malloc'd).
+ * Returns the entry, or NULL if it is too big to keep (body freed). */
+static http_cache_entry_t *cache_insert(const char *key, long status, char *body,
+                                        size_t size, const char *etag,
+                                        const char *last_modified, time_t expires) {
+    http_cache_entry_t *old = cache_find(key);
+    if (old) cache_remove(old);
+    mem_adopt(MEM_TAG_HTTP, body);
+
+    size_t cost = sizeof(http_cache_entry_t) + strlen(key) + size +
+                  (etag ? strlen(etag) : 0) + (last_modified ? strlen(last_modified) : 0);
+    if (cost > cache.max_bytes / 4) {
+        mem_free(MEM_TAG_HTTP, body);
+        return NULL;
+    }
+    while (cache.oldest && cache.stats.bytes + cost > cache.max_bytes) cache_remove(cache.oldest);
+
+    http_cache_entry_t *e = calloc(1, sizeof(*e));
+    if (!e) {
+        perror("Out of memory");
+        exit(1);
+    }
+    e->key = dup_or_null(key);
+    e->hash = cache_hash(key);
+    e->status = status;
+    e->body = body;
+    e->size = size;
+    e->etag = dup_or_null(etag);
+    e->last_modified = dup_or_null(last_modified);
+    e->expires = expires;
+    e->cost = cost;
+    e->chain = cache.buckets[e->hash % CACHE_BUCKETS];
+    cache.buckets[e->hash % CACHE_BUCKETS] = e;
+    cache_push_newest(e);
+    cache.stats.bytes += cost;
+    cache.stats.entries++;
+    return e;
+}
+
+/* ~/.loki/cache, created if missing (when ~/.loki exists) */
+static int cache_dir(char *buf, size_t size) {
+    const char *home = getenv("HOME");
+    struct stat st;
+    if (!home || !home[0]) return -1;
+    snprintf(buf, size, "%s/%s", home, LOKI_CONFIG_DIR);
+    if (stat(buf, &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    snprintf(buf, size, "%s/%s/cache", home, LOKI_CONFIG_DIR);
+    if (mkdir(buf, 0700) == -1 && errno != EEXIST) return -1;
+    return 0;
+}
+
+static int cache_path(const char *key, char *buf, size_t size) {
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(buf, size, "%s/http-%016llx", dir, (unsigned long long)cache_hash(key));
+    return 0;
+}
+
+/* Write an entry's file: a header line of lengths, then the key, the
+ * validators and the body. Written aside and renamed over, so a reader
+ * never sees half of one. */
+static void cache_disk_write(const http_cache_entry_t *e) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    if (!cache.disk || cache_path(e->key, path, sizeof(path)) != 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    size_t etag_len = e->etag ? strlen(e->etag) : 0;
+    size_t lm_len = e->last_modified ? strlen(e->last_modified) : 0;
+    fprintf(f, CACHE_FILE_MAGIC " %zu %ld %lld %zu %zu %zu\n", strlen(e->key), e->status,
+            (long long)e->expires, etag_len, lm_len, e->size);
+    fwrite(e->key, 1, strlen(e->key), f);
+    if (etag_len) fwrite(e->etag, 1, etag_len, f);
+    if (lm_len) fwrite(e->last_modified, 1, lm_len, f);
+    if (e->size) fwrite(e->body, 1, e->size, f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static void cache_disk_remove(const char *key) {
+    char path[PATH_MAX];
+    if (cache.disk && cache_path(key, path, sizeof(path)) == 0) unlink(path);
+}
+
+/* Read 'len' bytes of a cache file into a NUL-terminated string */
+static char *read_field(FILE *f, size_t len) {
+    if (len > LOKI_HTTP_MAX_RESPONSE_SIZE) return NULL;
+    char *s = malloc(len + 1);
+    if (!s) return NULL;
+    if (fread(s, 1, len, f) != len) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+/* The entry for a key from disk, brought into memory; or NULL */
+static http_cache_entry_t *cache_disk_read(const char *key) {
+    char path[PATH_MAX];
+    if (!cache.disk || cache_path(key, path, sizeof(path)) != 0) return NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    size_t key_len, etag_len, lm_len, size;
+    long status;
+    long long expires;
+    http_cache_entry_t *e = NULL;
+    char *stored_key = NULL, *etag = NULL, *lm = NULL, *body = NULL;
+    if (fscanf(f, CACHE_FILE_MAGIC " %zu %ld %lld %zu %zu %zu", &key_len, &status,
+               &expires, &etag_len, &lm_len, &size) == 6 &&
+        fgetc(f) == '\n' &&
+        (stored_key = read_field(f, key_len)) && strcmp(stored_key, key) == 0 &&
+        (etag = read_field(f, etag_len)) && (lm = read_field(f, lm_len)) &&
+        (body = read_field(f, size))) {
+        e = cache_insert(key, status, body, size, etag, lm, (time_t)expires);
+        body = NULL;
+    }
+    fclose(f);
+    free(stored_key);
+    free(etag);
+    free(lm);
+    free(body);
+    return e;
+}
+
+/* The entry for a key, from memory or else disk; or NULL */
+static http_cache_entry_t *cache_lookup(const char *key) {
+    http_cache_entry_t *e = cache_find(key);
+    if (!e && (e = cache_disk_read(key))) cache.stats.disk_hits++;
+    return e;
+}
+
+static void cache_headers_reset(http_cache_headers_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->max_age = -1;
+}
+
+static void parse_cache_control(http_cache_headers_t *h, const char *value) {
+    const char *p = value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        size_t len = strcspn(p, ",");
+        if (strncasecmp(p, "max-age=", 8) == 0) h->max_age = strtol(p + 8, NULL, 10);
+        else if (strncasecmp(p, "no-store", 8) == 0) h->no_store = 1;
+        else if (strncasecmp(p, "no-cache", 8) == 0) h->no_cache = 1;
+        p += len;
+    }
+}
+
+/* Curl header callback of a cached request: note what the headers say
+ * about caching, afresh for each response (redirects, 100 Continue) */
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t len = size * nitems;
+    http_cache_headers_t *h = userp;
+    char line[512];
+    size_t n = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, buffer, n);
+    line[n] = '\0';
+    while (n > 0 && (line[n - 1] == '\r' || line[n - 1] == '\n')) line[--n] = '\0';
+
+    if (strncmp(line, "HTTP/", 5) == 0) {
+        cache_headers_reset(h);
+        return len;
+    }
+    char *colon = strchr(line, ':');
+    if (!colon) return len;
+    *colon = '\0';
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+
+    if (strcasecmp(line, "cache-control") == 0) {
+        parse_cache_control(h, value);
+    } else if (strcasecmp(line, "etag") == 0) {
+        /* One cut short would never match */
+        if (strlen(value) < sizeof(h->etag)) snprintf(h->etag, sizeof(h->etag), "%s", value);
+    } else if (strcasecmp(line, "last-modified") == 0) {
+        if (strlen(value) < sizeof(h->last_modified))
+            snprintf(h->last_modified, sizeof(h->last_modified), "%s", value);
+    } else if (strcasecmp(line, "expires") == 0) {
+        time_t t = curl_getdate(value, NULL);
+        h->expires = t > 0 ? t : 1;     /* Invalid dates are in the past */
+    }
+    return len;
+}
+
+/* When a request's response stops being fresh: 0 to revalidate on each
+ * use, -1 if it is not to be kept */
+static time_t cache_expiry(const async_http_request_t *req, time_t now) {
+    const http_cache_headers_t *h = &req->cache_headers;
+    if (h->no_store) return -1;
+
+    time_t expires;
+    if (h->no_cache) expires = 0;
+    else if (h->max_age >= 0) expires = now + h->max_age;
+    else if (h->expires) expires = h->expires;
+    else if (req->cache_ttl > 0) expires = now + req->cache_ttl;
+    else expires = 0;
+    if (expires <= now) expires = 0;
+
+    /* Stale without a validator, it could only be fetched again */
+    if (expires == 0 && !h->etag[0] && !h->last_modified[0]) return -1;
+    return expires;
+}
+
+static void cache_clear_memory(void) {
+    while (cache.oldest) cache_remove(cache.oldest);
+}
+
+/* libcurl's allocator when memory is accounted (memstats.h) */
+static void *curl_malloc_cb(size_t size) {
+    return mem_malloc(MEM_TAG_HTTP, size);
+}
+
+static void curl_free_cb(void *p) {
+    mem_free(MEM_TAG_HTTP, p);
+}
+
+static void *curl_realloc_cb(void *p, size_t size) {
+    return mem_realloc(MEM_TAG_HTTP, p, size);
+}
+
+static char *curl_strdup_cb(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = mem_malloc(MEM_TAG_HTTP, len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+static void *curl_calloc_cb(size_t n, size_t size) {
+    return mem_calloc(MEM_TAG_HTTP, n, size);
+}
+
 /* ======================= Public API ======================= */
 
 void loki_http_init(void) {
     if (!curl_initialized) {
-        curl_global_init(CURL_GLOBAL_DEFAULT);
+        /* On the first request, not at startup */
+        uint64_t start = uv_hrtime();
+        if (memstats_enabled())
+            curl_global_init_mem(CURL_GLOBAL_DEFAULT, curl_malloc_cb, curl_free_cb,
+                                 curl_realloc_cb, curl_strdup_cb, curl_calloc_cb);
+        else
+            curl_global_init(CURL_GLOBAL_DEFAULT);
         curl_initialized = 1;
+        startup_note_deferred("libcurl", start);
     }
 }
 
@@ -120,19 +1223,30 @@ void loki_http_cleanup(void) {
     for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
         async_http_request_t *req = pending_requests[i];
         if (req) {
-            curl_multi_remove_handle(req->multi_handle, req->easy_handle);
-            curl_easy_cleanup(req->easy_handle);
-            curl_multi_cleanup(req->multi_handle);
-            if (req->header_list) {
-                curl_slist_free_all(req->header_list);
-            }
-            free(req->response.data);
-            free(req->lua_callback);
-            free(req);
+            if (!req->completed && !req->waiting) curl_multi_remove_handle(multi, req->easy_handle);
+            free_request(req);
             pending_requests[i] = NULL;
         }
     }
     num_pending = 0;
+    cache_clear_memory();
+
+    while (num_idle > 0) curl_easy_cleanup(idle_handles[--num_idle]);
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+
+    if (multi) {
+        curl_multi_cleanup(multi);
+        multi = NULL;
+        while (sockets) close_socket(sockets);
+        uv_timer_stop(&multi_timer);
+        uv_close((uv_handle_t *)&multi_timer, NULL);
+        uv_timer_stop(&delay_timer);
+        uv_close((uv_handle_t *)&delay_timer, NULL);
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);  /* Run the close callbacks */
+    }
 
     if (curl_initialized) {
         curl_global_cleanup();
@@ -171,9 +1285,12 @@ int loki_http_validate_url(const char *url, char *error_buf, size_t error_buf_si
     return 1;
 }
 
-int loki_http_request(editor_ctx_t *ctx, const char *url, const char *method,
-                      const char *body, const char **headers, int num_headers,
-                      const char *lua_callback) {
+int loki_http_request_ex(editor_ctx_t *ctx, const char *url, const char *method,
+                         const char *body, const char **headers, int num_headers,
+                         const char *lua_callback, const loki_http_request_opts_t *opts) {
+    static const loki_http_request_opts_t defaults;
+    if (!opts) opts = &defaults;
+    const char *cache_key = opts->cache_key;
     char error_buf[256];
 
     /* Validate URL */
@@ -188,203 +1305,524 @@ int loki_http_request(editor_ctx_t *ctx, const char *url, const char *method,
         return -1;
     }
 
-    /* Check rate limit */
-    if (!check_rate_limit()) {
+    if (opts->unix_socket &&
+        strlen(opts->unix_socket) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        if (ctx) editor_set_status_msg(ctx, "Unix socket path too long");
+        return -1;
+    }
+
+    /* A newer request supersedes those with its key */
+    if (opts->key) {
+        for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+            async_http_request_t *req = pending_requests[i];
+            if (req && !req->completed && req->key && strcmp(req->key, opts->key) == 0)
+                cancel_request(i);
+        }
+    }
+
+    /* One identical to a request waiting or in flight shares its
+     * response */
+    uint64_t signature = 0;
+    if (opts->coalesce && !opts->on_chunk) {
+        signature = request_signature(url, method, body, headers, num_headers, opts);
+        for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+            async_http_request_t *req = pending_requests[i];
+            if (!req || !req->coalesce || req->completed || req->signature != signature)
+                continue;
+            http_callback_t *joined = realloc(req->joined,
+                                              sizeof(*joined) * (size_t)(req->njoined + 1));
+            if (!joined) {
+                perror("Out of memory");
+                exit(1);
+            }
+            req->joined = joined;
+            req->joined[req->njoined].name = dup_or_null(lua_callback);
+            req->joined[req->njoined].ref = opts->callback_ref;
+            req->njoined++;
+            if (!req->callback_L) req->callback_L = opts->callback_L;
+            return i;
+        }
+    }
+
+    /* Check rate limit (debounced requests when they are sent) */
+    if (opts->debounce_ms <= 0 && !check_rate_limit()) {
         if (ctx) editor_set_status_msg(ctx, "Rate limit exceeded");
         return -1;
     }
 
     /* Check max pending requests */
-    if (num_pending >= LOKI_HTTP_MAX_ASYNC_REQUESTS) {
+    int slot = free_slot();
+    if (slot < 0) {
         if (ctx) editor_set_status_msg(ctx, "Too many pending requests");
         return -1;
     }
 
-    loki_http_init();
+    async_http_request_t *req = new_request(url, opts->unix_socket);
+    if (!req) return -1;
 
-    /* Find free slot */
-    int slot = -1;
-    for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
-        if (!pending_requests[i]) {
-            slot = i;
-            break;
+    req->callback.name = dup_or_null(lua_callback);
+    req->callback.ref = opts->callback_ref;
+
+    req->id = slot;
+    req->serial = ++next_serial;
+    req->ctx = ctx;
+    req->key = dup_or_null(opts->key);
+    req->coalesce = opts->coalesce && !opts->on_chunk;
+    req->signature = signature;
+    if (opts->on_chunk) {
+        req->mode = opts->mode;
+        req->on_chunk = opts->on_chunk;
+        req->chunk_data = opts->chunk_data;
+        curl_easy_setopt(req->easy_handle, CURLOPT_WRITEFUNCTION, stream_write_callback);
+        curl_easy_setopt(req->easy_handle, CURLOPT_WRITEDATA, req);
+        if (opts->mode == LOKI_HTTP_STREAM_SSE) {
+            req->sse.data = mem_malloc(MEM_TAG_HTTP, 1);
+            if (!req->sse.data) {
+                free_request(req);
+                return -1;
+            }
+            req->sse.data[0] = '\0';
+            req->sse.capacity = 1;
         }
     }
-    if (slot == -1) return -1;
 
-    /* Allocate request */
-    async_http_request_t *req = malloc(sizeof(async_http_request_t));
-    if (!req) return -1;
+    /* Set headers */
+    req->header_list = NULL;
+    if (headers && num_headers > 0) {
+        for (int i = 0; i < num_headers; i++) {
+            req->header_list = curl_slist_append(req->header_list, headers[i]);
+        }
+    }
 
-    memset(req, 0, sizeof(async_http_request_t));
-    req->response.data = malloc(1);
-    if (!req->response.data) {
-        free(req);
-        return -1;
+    /* Set method */
+    if (method && strcmp(method, "POST") == 0) {
+        curl_easy_setopt(req->easy_handle, CURLOPT_POST, 1L);
+        if (body) set_post_body(req, body, opts->compress_min);
     }
-    req->response.data[0] = '\0';
-    req->response.size = 0;
 
-    req->lua_callback = strdup(lua_callback);
-    if (!req->lua_callback) {
-        free(req->response.data);
-        free(req);
-        return -1;
+    /* Cached: note the response's caching headers, and revalidate the
+     * entry there is with its validators */
+    if (cache_key) {
+        req->cache_key = dup_or_null(cache_key);
+        req->cache_ttl = opts->cache_ttl;
+        cache_headers_reset(&req->cache_headers);
+        curl_easy_setopt(req->easy_handle, CURLOPT_HEADERFUNCTION, header_callback);
+        curl_easy_setopt(req->easy_handle, CURLOPT_HEADERDATA, &req->cache_headers);
+
+        http_cache_entry_t *entry = cache_lookup(cache_key);
+        char line[320];
+        if (entry && entry->etag) {
+            snprintf(line, sizeof(line), "If-None-Match: %s", entry->etag);
+            req->header_list = curl_slist_append(req->header_list, line);
+        }
+        if (entry && entry->last_modified) {
+            snprintf(line, sizeof(line), "If-Modified-Since: %s", entry->last_modified);
+            req->header_list = curl_slist_append(req->header_list, line);
+        }
+    }
+    if (req->header_list) curl_easy_setopt(req->easy_handle, CURLOPT_HTTPHEADER, req->header_list);
+
+    /* Debounced: hold it until its time comes */
+    if (opts->debounce_ms > 0) {
+        uv_update_time(uv_default_loop());
+        req->waiting = 1;
+        req->send_at = uv_now(uv_default_loop()) + (uint64_t)opts->debounce_ms;
+        req->callback_L = opts->callback_L;
+        pending_requests[slot] = req;
+        num_pending++;
+        arm_delay_timer();
+        return slot;
     }
 
-    /* Initialize curl handles */
-    req->easy_handle = curl_easy_init();
-    if (!req->easy_handle) {
-        free(req->response.data);
-        free(req->lua_callback);
-        free(req);
-        return -1;
+    /* Add to the shared multi handle; its timer callback starts it */
+    if (submit_request(req, slot) != 0) return -1;
+    req->callback_L = opts->callback_L;
+
+    if (ctx) editor_set_status_msg(ctx, "HTTP request sent...");
+
+    return slot;
+}
+
+int loki_http_request(editor_ctx_t *ctx, const char *url, const char *method,
+                      const char *body, const char **headers, int num_headers,
+                      const char *lua_callback) {
+    return loki_http_request_ex(ctx, url, method, body, headers, num_headers, lua_callback,
+                                NULL);
+}
+
+int loki_http_stream(editor_ctx_t *ctx, const char *url, const char *method,
+                     const char *body, const char **headers, int num_headers,
+                     const char *lua_callback, loki_http_stream_mode_t mode,
+                     loki_http_chunk_fn on_chunk, void *chunk_data) {
+    loki_http_request_opts_t opts = { .mode = mode, .on_chunk = on_chunk,
+                                      .chunk_data = chunk_data };
+    return loki_http_request_ex(ctx, url, method, body, headers, num_headers, lua_callback,
+                                &opts);
+}
+
+int loki_http_get_stats(const char *host, loki_http_stats_t *stats) {
+    if (!host) {
+        *stats = stats_all;
+        return 0;
+    }
+    for (int i = 0; i < stats_nhosts; i++) {
+        if (strcmp(stats_hosts[i].name, host) == 0) {
+            *stats = stats_hosts[i].stats;
+            return 0;
+        }
     }
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+}
 
-    req->multi_handle = curl_multi_init();
-    if (!req->multi_handle) {
-        curl_easy_cleanup(req->easy_handle);
-        free(req->response.data);
-        free(req->lua_callback);
-        free(req);
+const char *loki_http_stats_host(int i) {
+    return i >= 0 && i < stats_nhosts ? stats_hosts[i].name : NULL;
+}
+
+void loki_http_reset_stats(void) {
+    memset(&stats_all, 0, sizeof(stats_all));
+    stats_nhosts = 0;
+}
+
+int loki_http_cancel(int id) {
+    if (id < 0 || id >= LOKI_HTTP_MAX_ASYNC_REQUESTS || !pending_requests[id] ||
+        pending_requests[id]->completed)
         return -1;
+    cancel_request(id);
+    return 0;
+}
+
+void loki_http_cache_configure(size_t max_bytes, int disk) {
+    cache.max_bytes = max_bytes;
+    cache.disk = disk;
+    while (cache.oldest && cache.stats.bytes > cache.max_bytes) cache_remove(cache.oldest);
+}
+
+void loki_http_cache_clear(void) {
+    cache_clear_memory();
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir)) != 0) return;
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (strncmp(ent->d_name, "http-", 5) != 0) continue;
+        char path[PATH_MAX];
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) < sizeof(path))
+            unlink(path);
     }
+    closedir(d);
+}
 
-    /* Set curl options */
-    curl_easy_setopt(req->easy_handle, CURLOPT_URL, url);
-    curl_easy_setopt(req->easy_handle, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(req->easy_handle, CURLOPT_WRITEDATA, &req->response);
-    curl_easy_setopt(req->easy_handle, CURLOPT_ERRORBUFFER, req->error_buffer);
-    curl_easy_setopt(req->easy_handle, CURLOPT_TIMEOUT, (long)LOKI_HTTP_TIMEOUT);
-    curl_easy_setopt(req->easy_handle, CURLOPT_CONNECTTIMEOUT, (long)LOKI_HTTP_CONNECT_TIMEOUT);
-    curl_easy_setopt(req->easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
+void loki_http_cache_get_stats(loki_http_cache_stats_t *stats) {
+    *stats = cache.stats;
+    stats->max_bytes = cache.max_bytes;
+}
+
+/* Milliseconds of a CURLINFO_*_TIME_T */
+static double info_ms(CURL *easy, CURLINFO info) {
+    curl_off_t us = 0;
+    curl_easy_getinfo(easy, info, &us);
+    return (double)us / 1000.0;
+}
 
-    /* SSL/TLS settings */
-    curl_easy_setopt(req->easy_handle, CURLOPT_SSL_VERIFYPEER, 1L);
-    curl_easy_setopt(req->easy_handle, CURLOPT_SSL_VERIFYHOST, 2L);
+/* Where a completed transfer's time went */
+static void get_timing(CURL *easy, loki_http_timing_t *t) {
+    double lookup = info_ms(easy, CURLINFO_NAMELOOKUP_TIME_T);
+    double connect = info_ms(easy, CURLINFO_CONNECT_TIME_T);
+    double tls = info_ms(easy, CURLINFO_APPCONNECT_TIME_T);
+    t->dns = lookup;
+    t->connect = connect > lookup ? connect - lookup : 0;
+    t->tls = tls > connect ? tls - connect : 0;
+    t->ttfb = info_ms(easy, CURLINFO_STARTTRANSFER_TIME_T);
+    t->total = info_ms(easy, CURLINFO_TOTAL_TIME_T);
+
+    curl_off_t down = 0, up = 0;
+    long connects = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+    t->bytes_down = down > 0 ? (uint64_t)down : 0;
+    t->bytes_up = up > 0 ? (uint64_t)up : 0;
+    t->reused = connects == 0 && t->ttfb > 0;  /* Not a connect that failed */
+}
 
-    const char *ca_bundle = detect_ca_bundle_path();
-    if (ca_bundle) {
-        curl_easy_setopt(req->easy_handle, CURLOPT_CAINFO, ca_bundle);
+static void stats_add(loki_http_stats_t *st, const loki_http_timing_t *t, int failed) {
+    double phase[LOKI_HTTP_TIMING_PHASES] = { t->dns, t->connect, t->tls, t->ttfb, t->total };
+    st->requests++;
+    if (failed) st->failed++;
+    if (t->reused) st->reused++;
+    st->bytes_down += t->bytes_down;
+    st->bytes_up += t->bytes_up;
+    for (int i = 0; i < LOKI_HTTP_TIMING_PHASES; i++) {
+        st->sum[i] += phase[i];
+        if (phase[i] > st->max[i]) st->max[i] = phase[i];
     }
+}
 
-    /* Debug mode */
-    if (getenv("LOKI_DEBUG")) {
-        curl_easy_setopt(req->easy_handle, CURLOPT_VERBOSE, 1L);
+/* Total a completed transfer's timing, and its host's */
+static void record_timing(CURL *easy, const loki_http_timing_t *t, int failed) {
+    stats_add(&stats_all, t, failed);
+
+    const char *url = NULL;
+    curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+    const char *host = url ? strstr(url, "://") : NULL;
+    if (!host) return;
+    host += 3;
+    size_t len = strcspn(host, ":/?#");
+    if (len == 0 || len >= sizeof(stats_hosts[0].name)) return;
+
+    int i;
+    for (i = 0; i < stats_nhosts; i++) {
+        if (strncmp(stats_hosts[i].name, host, len) == 0 && stats_hosts[i].name[len] == '\0')
+            break;
+    }
+    if (i == stats_nhosts) {
+        if (stats_nhosts == LOKI_HTTP_STATS_HOSTS) return;  /* Only in the total */
+        memcpy(stats_hosts[i].name, host, len);
+        stats_hosts[i].name[len] = '\0';
+        memset(&stats_hosts[i].stats, 0, sizeof(stats_hosts[i].stats));
+        stats_nhosts++;
     }
+    stats_add(&stats_hosts[i].stats, t, failed);
+}
 
-    /* Set method */
-    if (method && strcmp(method, "POST") == 0) {
-        curl_easy_setopt(req->easy_handle, CURLOPT_POST, 1L);
-        if (body) {
-            curl_easy_setopt(req->easy_handle, CURLOPT_POSTFIELDS, body);
-        }
+static void push_timing(lua_State *L, const loki_http_timing_t *t) {
+    lua_newtable(L);
+    lua_pushnumber(L, t->dns);
+    lua_setfield(L, -2, "dns");
+    lua_pushnumber(L, t->connect);
+    lua_setfield(L, -2, "connect");
+    lua_pushnumber(L, t->tls);
+    lua_setfield(L, -2, "tls");
+    lua_pushnumber(L, t->ttfb);
+    lua_setfield(L, -2, "ttfb");
+    lua_pushnumber(L, t->total);
+    lua_setfield(L, -2, "total");
+    lua_pushinteger(L, (lua_Integer)t->bytes_down);
+    lua_setfield(L, -2, "bytes_down");
+    lua_pushinteger(L, (lua_Integer)t->bytes_up);
+    lua_setfield(L, -2, "bytes_up");
+    lua_pushboolean(L, t->reused);
+    lua_setfield(L, -2, "reused");
+}
+
+/* Call back with a response table: status, body, error, cached when the
+ * response cache answered, and the transfer's timing if there was one.
+ * A callback held by reference is let go. */
+static void call_lua_callback(lua_State *L, http_callback_t *cb, long status,
+                              const char *body, size_t body_len, const char *error,
+                              int cached, const loki_http_timing_t *timing) {
+    if (cb->ref > 0) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->ref);
+        cb->ref = 0;
+    } else if (cb->name) {
+        lua_getglobal(L, cb->name);
+    } else {
+        return;
+    }
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        return;
     }
 
-    /* Set headers */
-    req->header_list = NULL;
-    if (headers && num_headers > 0) {
-        for (int i = 0; i < num_headers; i++) {
-            req->header_list = curl_slist_append(req->header_list, headers[i]);
-        }
-        curl_easy_setopt(req->easy_handle, CURLOPT_HTTPHEADER, req->header_list);
+    /* Create response table */
+    lua_newtable(L);
+
+    lua_pushinteger(L, (lua_Integer)status);
+    lua_setfield(L, -2, "status");
+
+    if (body && body_len > 0) {
+        lua_pushlstring(L, body, body_len);
+    } else {
+        lua_pushnil(L);
     }
+    lua_setfield(L, -2, "body");
 
-    /* Add to multi handle */
-    curl_multi_add_handle(req->multi_handle, req->easy_handle);
+    if (error) {
+        lua_pushstring(L, error);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "error");
 
-    /* Store request */
-    pending_requests[slot] = req;
-    num_pending++;
+    if (cached) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "cached");
+    }
 
-    if (ctx) editor_set_status_msg(ctx, "HTTP request sent...");
+    if (timing) {
+        push_timing(L, timing);
+        lua_setfield(L, -2, "timing");
+    }
 
-    return slot;
+    if (lua_profile_pcall(L, LUA_PROFILE_HTTP, 1, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        fprintf(stderr, "HTTP callback error: %s\n", err);
+        lua_pop(L, 1);
+    }
+}
+
+/* Bring a cached request's response into the cache: keep a 200 that may
+ * be kept, and answer a 304 from the entry it revalidated */
+static void cache_complete(async_http_request_t *req, long *status, const char **body,
+                           size_t *body_len, int *cached) {
+    time_t now = time(NULL);
+    time_t expires = cache_expiry(req, now);
+    const http_cache_headers_t *h = &req->cache_headers;
+
+    if (*status == 304) {
+        http_cache_entry_t *entry = cache_lookup(req->cache_key);
+        if (!entry) return;
+        entry->expires = expires > 0 ? expires : 0;
+        if (h->etag[0] && (!entry->etag || strcmp(entry->etag, h->etag) != 0)) {
+            free(entry->etag);
+            entry->etag = dup_or_null(h->etag);
+        }
+        cache_disk_write(entry);
+        cache.stats.revalidated++;
+        *status = entry->status;
+        *body = entry->body;
+        *body_len = entry->size;
+        *cached = 1;
+    } else if (*status == 200 && expires >= 0) {
+        char *copy = malloc(*body_len + 1);
+        if (!copy) return;
+        memcpy(copy, *body, *body_len);
+        copy[*body_len] = '\0';
+        http_cache_entry_t *entry = cache_insert(req->cache_key, 200, copy, *body_len,
+                                                 h->etag, h->last_modified, expires);
+        if (entry) {
+            cache.stats.stored++;
+            cache_disk_write(entry);
+        }
+    } else if (*status == 200) {
+        /* No longer to be kept */
+        http_cache_entry_t *entry = cache_find(req->cache_key);
+        if (entry) cache_remove(entry);
+        cache_disk_remove(req->cache_key);
+    }
+}
+
+/* Registry table of streaming requests' Lua chunk functions, by id */
+static void push_streams_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "loki_http_streams");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, "loki_http_streams");
+    }
+}
+
+/* Chunk function of requests from Lua: on_chunk(text, id) */
+static void lua_chunk(editor_ctx_t *ctx, int id, const char *data, size_t len,
+                      void *userdata) {
+    lua_State *L = userdata;
+    push_streams_table(L);
+    lua_rawgeti(L, -1, id);
+    lua_remove(L, -2);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pushlstring(L, data, len);
+    lua_pushinteger(L, id);
+    if (lua_profile_pcall(L, LUA_PROFILE_HTTP, 2, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        if (ctx) editor_set_status_msg(ctx, "HTTP chunk error: %s", err ? err : "unknown error");
+        else fprintf(stderr, "HTTP chunk error: %s\n", err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
 }
 
 void loki_http_poll(lua_State *L) {
+    /* Without the event loop nothing else runs the libuv handles */
+    if (!event_loop_active() && multi) uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+
     for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
         async_http_request_t *req = pending_requests[i];
         if (!req) continue;
+        if (req->on_chunk && !stream_caught_up(req)) continue;
+        if (!req->completed) continue;
+
+        /* Get response code */
+        long response_code = 0;
+        curl_easy_getinfo(req->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+
+        /* A request failed before it was sent has no transfer to time */
+        loki_http_timing_t timing;
+        int timed = !(req->failed && info_ms(req->easy_handle, CURLINFO_TOTAL_TIME_T) == 0);
+        if (timed) {
+            get_timing(req->easy_handle, &timing);
+            record_timing(req->easy_handle, &timing, req->failed);
+        }
 
-        /* Perform non-blocking work */
-        int still_running = 0;
-        curl_multi_perform(req->multi_handle, &still_running);
-
-        if (still_running == 0) {
-            /* Request completed */
-            int msgs_left = 0;
-            CURLMsg *msg = NULL;
-
-            while ((msg = curl_multi_info_read(req->multi_handle, &msgs_left))) {
-                if (msg->msg == CURLMSG_DONE) {
-                    if (msg->data.result != CURLE_OK) {
-                        req->failed = 1;
-                        if (req->error_buffer[0] == '\0') {
-                            snprintf(req->error_buffer, CURL_ERROR_SIZE, "%s",
-                                     curl_easy_strerror(msg->data.result));
-                        }
-                    }
-                }
-            }
-
-            /* Get response code */
-            long response_code = 0;
-            curl_easy_getinfo(req->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
-
-            /* Call Lua callback */
-            if (L && req->lua_callback) {
-                lua_getglobal(L, req->lua_callback);
-                if (lua_isfunction(L, -1)) {
-                    /* Create response table */
-                    lua_newtable(L);
+        const char *body = req->response.data;
+        size_t body_len = req->response.size;
+        int cached = 0;
+        if (req->cache_key && !req->failed) {
+            cache_complete(req, &response_code, &body, &body_len, &cached);
+        }
 
-                    lua_pushinteger(L, (lua_Integer)response_code);
-                    lua_setfield(L, -2, "status");
+        /* Call Lua callback */
+        if (L) {
+            const char *error = NULL;
+            char errbuf[128];
+            if (req->failed && req->error_buffer[0] != '\0') {
+                error = req->error_buffer;
+            } else if (response_code >= 400) {
+                snprintf(errbuf, sizeof(errbuf), "HTTP error %ld", response_code);
+                error = errbuf;
+            }
+            call_lua_callback(L, &req->callback, response_code, body, body_len,
+                              error, cached, timed ? &timing : NULL);
+            for (int j = 0; j < req->njoined; j++) {
+                call_lua_callback(L, &req->joined[j], response_code, body, body_len,
+                                  error, cached, timed ? &timing : NULL);
+            }
+        }
 
-                    if (req->response.data && req->response.size > 0) {
-                        lua_pushstring(L, req->response.data);
-                    } else {
-                        lua_pushnil(L);
-                    }
-                    lua_setfield(L, -2, "body");
-
-                    if (req->failed && req->error_buffer[0] != '\0') {
-                        lua_pushstring(L, req->error_buffer);
-                    } else if (response_code >= 400) {
-                        char errbuf[128];
-                        snprintf(errbuf, sizeof(errbuf), "HTTP error %ld", response_code);
-                        lua_pushstring(L, errbuf);
-                    } else {
-                        lua_pushnil(L);
-                    }
-                    lua_setfield(L, -2, "error");
+        /* Drop its Lua chunk function */
+        if (L && req->on_chunk == lua_chunk) {
+            push_streams_table(L);
+            lua_pushnil(L);
+            lua_rawseti(L, -2, i);
+            lua_pop(L, 1);
+        }
 
-                    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
-                        const char *err = lua_tostring(L, -1);
-                        fprintf(stderr, "HTTP callback error: %s\n", err);
-                        lua_pop(L, 1);
-                    }
-                } else {
-                    lua_pop(L, 1);
-                }
-            }
+        /* Cleanup request */
+        free_request(req);
+        pending_requests[i] = NULL;
+        num_pending--;
+    }
+}
 
-            /* Cleanup request */
-            curl_multi_remove_handle(req->multi_handle, req->easy_handle);
-            curl_easy_cleanup(req->easy_handle);
-            curl_multi_cleanup(req->multi_handle);
-            if (req->header_list) {
-                curl_slist_free_all(req->header_list);
-            }
-            free(req->response.data);
-            free(req->lua_callback);
-            free(req);
+int loki_http_preconnect(const char *url) {
+    if (!loki_http_validate_url(url, NULL, 0)) return -1;
 
-            pending_requests[i] = NULL;
-            num_pending--;
+    /* Already connected, or connecting */
+    for (int i = 0; i < LOKI_HTTP_MAX_ASYNC_REQUESTS; i++) {
+        async_http_request_t *req = pending_requests[i];
+        if (req && req->preconnect && !req->completed) {
+            const char *req_url = NULL;
+            curl_easy_getinfo(req->easy_handle, CURLINFO_EFFECTIVE_URL, &req_url);
+            if (req_url && strcmp(req_url, url) == 0) return 0;
         }
     }
+
+    int slot = free_slot();
+    if (slot < 0) return -1;
+    async_http_request_t *req = new_request(url, NULL);
+    if (!req) return -1;
+
+    /* A HEAD request: the connection it leaves in the pool is the point,
+     * whatever the endpoint answers. CURLOPT_CONNECT_ONLY would keep the
+     * connection from being reused. */
+    req->preconnect = 1;
+    curl_easy_setopt(req->easy_handle, CURLOPT_NOBODY, 1L);
+    return submit_request(req, slot);
 }
 
 int loki_http_pending_count(void) {
@@ -393,6 +1831,54 @@ int loki_http_pending_count(void) {
 
 /* ======================= Lua Binding ======================= */
 
+/* Whether a header (a "Name: value" line) carries credentials */
+static int is_credential_header(const char *header) {
+    static const char *const names[] = { "Authorization", "Proxy-Authorization", "Cookie",
+                                         "X-Api-Key", "Api-Key" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t len = strlen(names[i]);
+        if (strncasecmp(header, names[i], len) == 0 && header[len] == ':') return 1;
+    }
+    return 0;
+}
+
+/* Push the cache key of a request: its method, URL, 'extra' and the
+ * headers in the table at 'headers', as they may vary the response.
+ * Requests with credentials aren't cached (their responses are one
+ * user's, and keys are written to disk): nothing is pushed, NULL returned. */
+static const char *push_cache_key(lua_State *L, int headers, const char *method,
+                                  const char *url, const char *extra) {
+    char *lines = NULL;
+    size_t len = 0;
+    if (lua_istable(L, headers)) {
+        lua_pushnil(L);
+        while (lua_next(L, headers) != 0) {
+            const char *header = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+            if (is_credential_header(header)) {
+                lua_pop(L, 2);
+                free(lines);
+                return NULL;
+            }
+            size_t n = strlen(header);
+            char *grown = realloc(lines, len + n + 2);
+            if (!grown) {
+                free(lines);
+                luaL_error(L, "Out of memory");
+                return NULL;
+            }
+            lines = grown;
+            lines[len++] = '\n';
+            memcpy(lines + len, header, n + 1);
+            len += n;
+            lua_pop(L, 1);
+        }
+    }
+    const char *key = lua_pushfstring(L, "%s %s\n%s%s", method, url, extra ? extra : "",
+                                      lines ? lines : "");
+    free(lines);
+    return key;
+}
+
 int lua_loki_async_http(lua_State *L) {
     const char *url = luaL_checkstring(L, 1);
     const char *method = luaL_optstring(L, 2, "GET");
@@ -412,6 +1898,105 @@ int lua_loki_async_http(lua_State *L) {
         return 1;
     }
 
+    /* The callback: a function, or the name of one. A global that is a
+     * function already is held by reference, not looked up again. */
+    if (lua_type(L, 5) == LUA_TSTRING) {
+        lua_getglobal(L, lua_tostring(L, 5));
+        if (lua_isfunction(L, -1)) lua_replace(L, 5);
+        else lua_pop(L, 1);
+    } else if (!lua_isfunction(L, 5)) {
+        return luaL_argerror(L, 5, "function or global name expected");
+    }
+
+    /* Streaming options: { on_chunk = fn or global name, sse = bool } */
+    int chunk_fn = 0;
+    loki_http_stream_mode_t mode = LOKI_HTTP_STREAM_RAW;
+    if (lua_istable(L, 6)) {
+        lua_getfield(L, 6, "sse");
+        if (lua_toboolean(L, -1)) mode = LOKI_HTTP_STREAM_SSE;
+        lua_pop(L, 1);
+        lua_getfield(L, 6, "on_chunk");
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            const char *name = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            lua_getglobal(L, name);
+        }
+        if (lua_isfunction(L, -1)) {
+            chunk_fn = lua_gettop(L);
+        } else if (!lua_isnil(L, -1)) {
+            return luaL_error(L, "on_chunk must be a function or the name of one");
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    /* Request options: { key = string, debounce = ms, coalesce = bool,
+     * compress = true or bytes, unix_socket = path } */
+    loki_http_request_opts_t opts = { .mode = mode, .on_chunk = chunk_fn ? lua_chunk : NULL,
+                                      .chunk_data = L };
+    if (lua_istable(L, 6)) {
+        lua_getfield(L, 6, "key");
+        if (lua_type(L, -1) == LUA_TSTRING) opts.key = lua_tostring(L, -1);
+        lua_getfield(L, 6, "debounce");
+        if (lua_type(L, -1) == LUA_TNUMBER) opts.debounce_ms = (long)lua_tointeger(L, -1);
+        lua_getfield(L, 6, "coalesce");
+        opts.coalesce = lua_toboolean(L, -1);
+        lua_getfield(L, 6, "compress");
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            lua_Integer min = lua_tointeger(L, -1);
+            opts.compress_min = min > 0 ? (size_t)min : 1;
+        } else if (lua_toboolean(L, -1)) {
+            opts.compress_min = LOKI_HTTP_COMPRESS_MIN;
+        }
+        lua_pop(L, 3);      /* The key stays on the stack until we return */
+        lua_getfield(L, 6, "unix_socket");  /* So does this */
+        if (lua_type(L, -1) == LUA_TSTRING) opts.unix_socket = lua_tostring(L, -1);
+    }
+
+    /* Caching options: { cache = true or seconds fresh, cache_key = string }.
+     * GET requests may be cached, POST ones with a key of their own; not
+     * those sending credentials. */
+    const char *cache_key = NULL;
+    long cache_ttl = 0;
+    if (lua_istable(L, 6) && !chunk_fn) {
+        lua_getfield(L, 6, "cache");
+        int want = lua_toboolean(L, -1);
+        if (lua_type(L, -1) == LUA_TNUMBER) cache_ttl = (long)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 6, "cache_key");
+        const char *extra = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+        int get = strcmp(method, "GET") == 0;
+        if (want && (get || (extra && strcmp(method, "POST") == 0))) {
+            /* Stays on the stack until we return */
+            cache_key = push_cache_key(L, 4, method, url, extra);
+        }
+    }
+
+    http_callback_t callback = { NULL, 0 };
+    const char *callback_name = NULL;
+    if (lua_isfunction(L, 5)) {
+        lua_pushvalue(L, 5);
+        callback.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        callback_name = lua_tostring(L, 5);
+    }
+    opts.callback_ref = callback.ref;
+    opts.callback_L = L;
+
+    /* A fresh cache entry answers now */
+    if (cache_key) {
+        http_cache_entry_t *entry = cache_lookup(cache_key);
+        if (entry && entry->expires > time(NULL)) {
+            cache.stats.hits++;
+            callback.name = (char *)callback_name;
+            call_lua_callback(L, &callback, entry->status, entry->body, entry->size,
+                              NULL, 1, NULL);
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+        cache.stats.misses++;
+    }
+
     /* Parse headers table */
     const char **headers = NULL;
     int num_headers = 0;
@@ -446,15 +2031,23 @@ int lua_loki_async_http(lua_State *L) {
         }
     }
 
-    const char *callback = luaL_checkstring(L, 5);
-
     /* Get editor context from Lua registry */
     lua_getfield(L, LUA_REGISTRYINDEX, "loki_ctx");
     editor_ctx_t *ctx = lua_touserdata(L, -1);
     lua_pop(L, 1);
 
     /* Start request */
-    int req_id = loki_http_request(ctx, url, method, body, headers, num_headers, callback);
+    opts.cache_key = cache_key;
+    opts.cache_ttl = cache_ttl;
+    int req_id = loki_http_request_ex(ctx, url, method, body, headers, num_headers,
+                                      callback_name, &opts);
+    if (req_id < 0 && callback.ref > 0) luaL_unref(L, LUA_REGISTRYINDEX, callback.ref);
+    if (req_id >= 0 && chunk_fn) {
+        push_streams_table(L);
+        lua_pushvalue(L, chunk_fn);
+        lua_rawseti(L, -2, req_id);
+        lua_pop(L, 1);
+    }
 
     /* Free headers */
     if (headers) {
@@ -472,3 +2065,141 @@ int lua_loki_async_http(lua_State *L) {
 
     return 1;
 }
+
+/* The awaitable loki.http() returns: start the request its options
+ * (upvalue 1) describe, with the callback it is given. A request that
+ * could not start calls back at once with the reason. */
+static int lua_http_start(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int opts = lua_upvalueindex(1);
+    lua_pushcfunction(L, lua_loki_async_http);
+    lua_getfield(L, opts, "url");
+    lua_getfield(L, opts, "method");
+    lua_getfield(L, opts, "body");
+    lua_getfield(L, opts, "headers");
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, opts);
+    lua_call(L, 6, 1);
+    if (!lua_isnil(L, -1)) return 0;
+
+    char error[256];
+    lua_getfield(L, opts, "url");
+    if (loki_http_validate_url(lua_tostring(L, -1), error, sizeof(error)))
+        snprintf(error, sizeof(error), "Request could not be started");
+    lua_pushvalue(L, 1);
+    lua_newtable(L);
+    lua_pushinteger(L, 0);
+    lua_setfield(L, -2, "status");
+    lua_pushstring(L, error);
+    lua_setfield(L, -2, "error");
+    lua_call(L, 1, 0);
+    return 0;
+}
+
+int lua_loki_http(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "url");
+    if (lua_type(L, -1) != LUA_TSTRING) return luaL_argerror(L, 1, "url expected");
+    lua_pop(L, 1);
+    lua_settop(L, 1);
+    lua_pushcclosure(L, lua_http_start, 1);
+    return 1;
+}
+
+int lua_loki_http_preconnect(lua_State *L) {
+    const char *url = luaL_checkstring(L, 1);
+    if (loki_http_preconnect(url) == 0) lua_pushboolean(L, 1);
+    else lua_pushnil(L);
+    return 1;
+}
+
+int lua_loki_http_cache(lua_State *L) {
+    if (lua_istable(L, 1)) {
+        loki_http_cache_stats_t st;
+        loki_http_cache_get_stats(&st);
+        size_t max_bytes = st.max_bytes;
+        int disk = cache.disk;
+        lua_getfield(L, 1, "max_bytes");
+        if (lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) >= 0)
+            max_bytes = (size_t)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "disk");
+        if (!lua_isnil(L, -1)) disk = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        loki_http_cache_configure(max_bytes, disk);
+        lua_getfield(L, 1, "clear");
+        if (lua_toboolean(L, -1)) loki_http_cache_clear();
+        lua_pop(L, 1);
+    }
+
+    loki_http_cache_stats_t st;
+    loki_http_cache_get_stats(&st);
+    lua_newtable(L);
+    lua_pushinteger(L, st.entries);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, (lua_Integer)st.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)st.max_bytes);
+    lua_setfield(L, -2, "max_bytes");
+    lua_pushinteger(L, (lua_Integer)st.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)st.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)st.revalidated);
+    lua_setfield(L, -2, "revalidated");
+    lua_pushinteger(L, (lua_Integer)st.disk_hits);
+    lua_setfield(L, -2, "disk_hits");
+    lua_pushinteger(L, (lua_Integer)st.stored);
+    lua_setfield(L, -2, "stored");
+    lua_pushboolean(L, cache.disk);
+    lua_setfield(L, -2, "disk");
+    return 1;
+}
+
+int lua_loki_http_cancel(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, id >= 0 && id < LOKI_HTTP_MAX_ASYNC_REQUESTS &&
+                           loki_http_cancel((int)id) == 0);
+    return 1;
+}
+
+static void push_stats(lua_State *L, const loki_http_stats_t *st) {
+    static const char *phases[LOKI_HTTP_TIMING_PHASES] = { "dns", "connect", "tls", "ttfb", "total" };
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)st->requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushinteger(L, (lua_Integer)st->failed);
+    lua_setfield(L, -2, "failed");
+    lua_pushinteger(L, (lua_Integer)st->reused);
+    lua_setfield(L, -2, "reused");
+    lua_pushinteger(L, (lua_Integer)st->bytes_down);
+    lua_setfield(L, -2, "bytes_down");
+    lua_pushinteger(L, (lua_Integer)st->bytes_up);
+    lua_setfield(L, -2, "bytes_up");
+    for (int i = 0; i < LOKI_HTTP_TIMING_PHASES; i++) {
+        lua_newtable(L);
+        lua_pushnumber(L, st->requests ? st->sum[i] / (double)st->requests : 0);
+        lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, st->max[i]);
+        lua_setfield(L, -2, "max");
+        lua_setfield(L, -2, phases[i]);
+    }
+}
+
+int lua_loki_http_stats(lua_State *L) {
+    loki_http_stats_t st;
+    loki_http_get_stats(NULL, &st);
+    push_stats(L, &st);
+
+    lua_newtable(L);
+    const char *host;
+    for (int i = 0; (host = loki_http_stats_host(i)); i++) {
+        loki_http_get_stats(host, &st);
+        push_stats(L, &st);
+        lua_setfield(L, -2, host);
+    }
+    lua_setfield(L, -2, "hosts");
+
+    if (lua_toboolean(L, 1)) loki_http_reset_stats();
+    return 1;
+}
@@ -2,18 +2,37 @@
  *
  * Provides asynchronous HTTP requests using libcurl.
  * Features:
- * - Non-blocking HTTP GET/POST requests
- * - Lua callback for response handling
+ * - Non-blocking HTTP GET/POST requests, sharing one multi handle (and
+ *   its connections) driven by the libuv loop
+ * - Connection reuse: pooled easy handles, a shared DNS cache and TLS
+ *   sessions, HTTP/2 multiplexing, and connecting ahead of time
+ * - Local model servers (loopback, or a Unix socket) reached without
+ *   proxies or TLS setup, their connection kept open between requests
+ * - Lua callback for response handling, and streaming through the async
+ *   queue: the body a piece at a time, or server-sent events' data
  * - Security validation (URL scheme, length, body size)
- * - Rate limiting (per-minute request limit)
+ * - Rate limiting (per-minute request limit), spent only on requests
+ *   that go out: keyed requests supersede older ones, debounced ones
+ *   wait before sending, and identical ones share a transfer
+ * - An opt-in response cache (LRU in memory, and on disk) honouring
+ *   Cache-Control, Expires and ETag/Last-Modified revalidation
+ * - Responses in any encoding curl can decode (gzip, brotli, zstd),
+ *   decoded as they arrive, and request bodies gzipped on request
+ * - Transfer timings (DNS, connect, TLS, first byte, total), bytes and
+ *   connection reuse, per request and totalled per host
  */
 
 #ifndef LOKI_HTTP_H
 #define LOKI_HTTP_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <lua.h>
 #include "loki/core.h"  /* For editor_ctx_t */
+#include "async_queue.h"
+
+/* Event carrying a piece of a streaming response to its chunk function */
+#define HTTP_CHUNK_ASYNC_EVENT (ASYNC_EVENT_USER + 4)
 
 /* Configuration constants */
 #define LOKI_HTTP_MAX_ASYNC_REQUESTS  10
@@ -23,6 +42,46 @@
 #define LOKI_HTTP_RATE_LIMIT          60      /* requests per minute */
 #define LOKI_HTTP_TIMEOUT             60      /* seconds */
 #define LOKI_HTTP_CONNECT_TIMEOUT     10      /* seconds */
+#define LOKI_HTTP_CACHE_SIZE          (8 * 1024 * 1024)   /* 8MB in memory */
+#define LOKI_HTTP_COMPRESS_MIN        (16 * 1024)         /* Bodies worth gzipping */
+#define LOKI_HTTP_LOCAL_MAXAGE        3600    /* seconds an idle local
+                                                 connection is kept */
+
+/* Where a transfer's time went, in milliseconds */
+typedef struct {
+    double dns;                     /* Name lookup (0 on a reused connection) */
+    double connect;                 /* TCP connect, after the lookup */
+    double tls;                     /* TLS handshake, after the connect */
+    double ttfb;                    /* Start to the first response byte */
+    double total;                   /* Start to the end */
+    uint64_t bytes_down, bytes_up;  /* Body bytes on the wire (encoded) */
+    int reused;                     /* Went over a connection already open */
+} loki_http_timing_t;
+
+#define LOKI_HTTP_TIMING_PHASES 5   /* dns .. total, in that order */
+#define LOKI_HTTP_STATS_HOSTS 16    /* Hosts totalled apart */
+
+/* Timings totalled over completed transfers */
+typedef struct {
+    uint64_t requests;              /* Transfers completed */
+    uint64_t failed;                /* Of them, with a transport error */
+    uint64_t reused;                /* Over a connection already open */
+    uint64_t bytes_down, bytes_up;
+    double sum[LOKI_HTTP_TIMING_PHASES];    /* Milliseconds, for the mean */
+    double max[LOKI_HTTP_TIMING_PHASES];
+} loki_http_stats_t;
+
+/* Response cache counters */
+typedef struct {
+    int entries;                    /* Responses in memory */
+    size_t bytes;                   /* Memory they hold */
+    size_t max_bytes;               /* Bound on it */
+    uint64_t hits;                  /* Requests answered at once */
+    uint64_t misses;                /* Cached requests that went out */
+    uint64_t revalidated;           /* Of them, answered by a 304 */
+    uint64_t disk_hits;             /* Entries read back from disk */
+    uint64_t stored;                /* Responses kept */
+} loki_http_cache_stats_t;
 
 /**
  * Initialize HTTP subsystem.
@@ -53,9 +112,136 @@ int loki_http_request(editor_ctx_t *ctx, const char *url, const char *method,
                       const char *body, const char **headers, int num_headers,
                       const char *lua_callback);
 
+/* How a streaming request splits its body into chunks */
+typedef enum {
+    LOKI_HTTP_STREAM_RAW = 0,       /* As curl receives it */
+    LOKI_HTTP_STREAM_SSE            /* Each server-sent event's data lines,
+                                       joined with newlines */
+} loki_http_stream_mode_t;
+
+/* Called on the main thread with each chunk of a streaming response, in
+ * order, before the request's final callback. 'data' is NUL-terminated. */
+typedef void (*loki_http_chunk_fn)(editor_ctx_t *ctx, int id, const char *data,
+                                   size_t len, void *userdata);
+
+/**
+ * Start an async HTTP request whose response is streamed.
+ * As loki_http_request(), but the body goes to 'on_chunk' as it
+ * arrives, through the async queue (directly without one); the Lua
+ * callback then gets no body, unless the status was an error (>= 400),
+ * whose body is kept whole. A full queue pauses the transfer rather than
+ * lose chunks.
+ *
+ * @param mode How the body is split into chunks
+ * @param on_chunk Chunk function (NULL: not streamed)
+ * @param chunk_data Passed to it
+ * @return Request ID (>= 0) on success, -1 on failure
+ */
+int loki_http_stream(editor_ctx_t *ctx, const char *url, const char *method,
+                     const char *body, const char **headers, int num_headers,
+                     const char *lua_callback, loki_http_stream_mode_t mode,
+                     loki_http_chunk_fn on_chunk, void *chunk_data);
+
+/* Options of loki_http_request_ex(); all zero is a plain request */
+typedef struct {
+    loki_http_stream_mode_t mode;   /* How a streamed body is split */
+    loki_http_chunk_fn on_chunk;    /* Stream the body (see loki_http_stream()) */
+    void *chunk_data;
+    const char *cache_key;          /* Go through the response cache under it */
+    long cache_ttl;                 /* Seconds fresh when the server doesn't say */
+    const char *key;                /* A newer request with the same key
+                                       cancels this one while in flight */
+    long debounce_ms;               /* Send only after this long, if not
+                                       superseded by then */
+    int coalesce;                   /* Requests identical to one waiting or in
+                                       flight share its response */
+    size_t compress_min;            /* Gzip a POST body of at least this many
+                                       bytes (0: never; needs zlib) */
+    int callback_ref;               /* Registry reference of the Lua function
+                                       to call back in place of lua_callback
+                                       (0: none); the request takes it over
+                                       unless it fails to start */
+    lua_State *callback_L;          /* The state holding callback_ref */
+    const char *unix_socket;        /* Connect through this Unix socket, the
+                                       URL's host only naming it (NULL: no) */
+} loki_http_request_opts_t;
+
 /**
- * Poll for completed HTTP requests.
- * Should be called periodically from main loop.
+ * Start an async HTTP request with options (NULL: none).
+ * A request superseded by one with its key is dropped without calling
+ * back. A debounced request is charged to the rate limit when it is
+ * sent, and fails then if over it. A coalesced request adds its callback
+ * to the identical request's and returns that one's ID.
+ *
+ * @return Request ID (>= 0) on success, -1 on failure
+ */
+int loki_http_request_ex(editor_ctx_t *ctx, const char *url, const char *method,
+                         const char *body, const char **headers, int num_headers,
+                         const char *lua_callback, const loki_http_request_opts_t *opts);
+
+/**
+ * Cancel a request still in flight (or waiting to be sent); it never
+ * calls back.
+ *
+ * @return 0, or -1 if there is no such request or it has completed
+ */
+int loki_http_cancel(int id);
+
+/**
+ * Connect to an endpoint ahead of its first request.
+ * Sends a HEAD request whose response is dropped, so DNS, TCP and TLS
+ * are done and the connection is in the pool when a real request comes.
+ * Subject to the pending request limit, not the rate limit.
+ *
+ * @param url URL on the endpoint's host (http:// or https://)
+ * @return 0 if started (or already under way), -1 on failure
+ */
+int loki_http_preconnect(const char *url);
+
+/**
+ * Set the response cache's memory bound (dropping the least recently
+ * used entries over it) and whether entries are also kept on disk, in
+ * ~/.loki/cache (when ~/.loki exists). Defaults: LOKI_HTTP_CACHE_SIZE,
+ * on disk.
+ */
+void loki_http_cache_configure(size_t max_bytes, int disk);
+
+/**
+ * Drop every cached response, in memory and on disk.
+ */
+void loki_http_cache_clear(void);
+
+/**
+ * Get the response cache's counters.
+ */
+void loki_http_cache_get_stats(loki_http_cache_stats_t *stats);
+
+/**
+ * Get the timings totalled over every transfer, and over a host's.
+ *
+ * @param host Host name, or NULL for all
+ * @param stats Output (zeroed for a host not seen)
+ * @return 0, or -1 for a host not seen
+ */
+int loki_http_get_stats(const char *host, loki_http_stats_t *stats);
+
+/**
+ * Get the name of the i'th host with timings totalled apart.
+ *
+ * @return The name, or NULL past the last
+ */
+const char *loki_http_stats_host(int i);
+
+/**
+ * Clear the totalled timings.
+ */
+void loki_http_reset_stats(void);
+
+/**
+ * Hand completed HTTP requests to Lua.
+ * Called from the main loop while requests are pending; transfers run
+ * from the libuv loop's handles, which this also runs when the editor
+ * is not waiting on that loop.
  * Invokes Lua callbacks for completed requests.
  *
  * @param L Lua state for callbacks
@@ -81,9 +267,60 @@ int loki_http_pending_count(void);
 int loki_http_validate_url(const char *url, char *error_buf, size_t error_buf_size);
 
 /**
- * Lua API: loki.async_http(url, method, body, headers, callback)
- * Registers an async HTTP request.
+ * Lua API: loki.async_http(url, method, body, headers, callback [, opts])
+ * Registers an async HTTP request. The callback is a function, or the
+ * name of a global one; either is held by registry reference from the
+ * start, a name that is not a function yet is looked up at the end.
+ * With opts.on_chunk (a function or global name) the response is
+ * streamed: on_chunk(text, id) gets each piece, or with opts.sse each
+ * server-sent event's data, as it arrives. With opts.cache (true, or
+ * seconds fresh when the server does not say) a GET, or a POST with
+ * opts.cache_key, goes through the response cache, keyed on its headers
+ * too (one sending Authorization, Cookie or an API key is not cached); a
+ * fresh entry calls back at once (response.cached set) and returns true
+ * instead of a request id. opts.key, opts.debounce (ms) and opts.coalesce are as in
+ * loki_http_request_opts_t; opts.compress (true, or a size in bytes)
+ * gzips a body at least LOKI_HTTP_COMPRESS_MIN (or that size) long.
+ * opts.unix_socket (a path) connects through a Unix socket, as to a
+ * local model server. Responses off the network carry a timing table
+ * (see loki_http_timing_t).
  */
 int lua_loki_async_http(lua_State *L);
 
+/**
+ * Lua API: loki.http(opts)
+ * Returns an awaitable for loki.await(): a function that, given a
+ * callback, starts the request opts describes (url, method, body,
+ * headers, then the options of loki.async_http) and calls back with the
+ * response. One that could not start calls back at once, with status 0
+ * and error set.
+ */
+int lua_loki_http(lua_State *L);
+
+/**
+ * Lua API: loki.http_preconnect(url)
+ * Returns true if the warm-up was started, nil otherwise.
+ */
+int lua_loki_http_preconnect(lua_State *L);
+
+/**
+ * Lua API: loki.http_cache([opts])
+ * Configures the response cache (opts.max_bytes, opts.disk, opts.clear)
+ * and returns its counters.
+ */
+int lua_loki_http_cache(lua_State *L);
+
+/**
+ * Lua API: loki.http_stats([reset])
+ * Returns the totalled timings, with a hosts table of each host's; with
+ * reset true, clears them after.
+ */
+int lua_loki_http_stats(lua_State *L);
+
+/**
+ * Lua API: loki.http_cancel(id)
+ * Returns true if the request was cancelled.
+ */
+int lua_loki_http_cancel(lua_State *L);
+
 #endif /* LOKI_HTTP_H */
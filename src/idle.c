@@ -0,0 +1,136 @@
+/* idle.c - Work split up to run on the main thread between frames
+ *
+ * See idle.h. Tasks are kept in an array in the order they were added.
+ * Finishing or cancelling one only clears its step; the array is
+ * compacted, and 'done' called, when no pass is running, so a step can
+ * never see its own arg freed under it.
+ */
+
+#include "idle.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct IdleTask {
+    int id;
+    const void *owner;
+    IdleStep step;              /* NULL: finished or cancelled */
+    IdleDone done;
+    void *arg;
+} IdleTask;
+
+static IdleTask *tasks;
+static int ntasks, tasks_cap;
+static int nlive;               /* Tasks with a step */
+static int next_id = 1;
+static int cursor;              /* Task the next pass starts with */
+static int running;             /* In idle_run() */
+
+/* Drop the tasks without a step, calling their 'done' */
+static void compact(void) {
+    int was_running = running;
+    running = 1;                /* 'done' may add or cancel tasks */
+    int n = 0;
+    for (int i = 0; i < ntasks; i++) {
+        IdleTask t = tasks[i];
+        if (t.step) {
+            tasks[n++] = t;
+            continue;
+        }
+        if (i < cursor) cursor--;
+        if (t.done) t.done(t.arg);    /* Tasks added go at the end */
+    }
+    ntasks = n;
+    if (cursor >= ntasks) cursor = 0;
+    running = was_running;
+}
+
+static void finish(IdleTask *t) {
+    t->step = NULL;
+    nlive--;
+}
+
+int idle_add(const void *owner, IdleStep step, IdleDone done, void *arg) {
+    if (ntasks == tasks_cap) {
+        int cap = tasks_cap ? tasks_cap * 2 : 16;
+        IdleTask *grown = realloc(tasks, sizeof(IdleTask) * (size_t)cap);
+        if (!grown) {
+            perror("Out of memory");
+            exit(1);
+        }
+        tasks = grown;
+        tasks_cap = cap;
+    }
+    IdleTask *t = &tasks[ntasks++];
+    t->id = next_id++;
+    if (next_id <= 0) next_id = 1;
+    t->owner = owner;
+    t->step = step;
+    t->done = done;
+    t->arg = arg;
+    nlive++;
+    return t->id;
+}
+
+int idle_cancel(int id) {
+    for (int i = 0; i < ntasks; i++) {
+        if (tasks[i].id != id) continue;
+        if (!tasks[i].step) return 0;
+        finish(&tasks[i]);
+        if (!running) compact();
+        return 1;
+    }
+    return 0;
+}
+
+void idle_cancel_owner(const void *owner) {
+    int found = 0;
+    for (int i = 0; i < ntasks; i++) {
+        if (tasks[i].owner != owner || !tasks[i].step) continue;
+        finish(&tasks[i]);
+        found = 1;
+    }
+    if (found && !running) compact();
+}
+
+int idle_pending(void) {
+    return nlive;
+}
+
+int idle_run(uint64_t budget_ns) {
+    if (nlive == 0 || budget_ns == 0 || running) return 0;
+
+    int damage = 0;
+    uint64_t deadline = uv_hrtime() + budget_ns;
+    running = 1;
+    while (nlive > 0 && uv_hrtime() < deadline) {
+        if (cursor >= ntasks) cursor = 0;
+        IdleTask *t = &tasks[cursor];
+        int id = t->id;
+        IdleStep step = t->step;
+        void *arg = t->arg;
+        cursor++;
+        if (!step) continue;
+
+        int rc = step(arg, deadline);
+        if (rc & IDLE_DAMAGE) damage = 1;
+        if ((rc & IDLE_MORE) == 0) {
+            /* The array may have grown: find it again */
+            for (int i = 0; i < ntasks; i++) {
+                if (tasks[i].id == id) {
+                    if (tasks[i].step) finish(&tasks[i]);
+                    break;
+                }
+            }
+        }
+    }
+    running = 0;
+    compact();
+    return damage;
+}
+
+uint64_t idle_budget(int timeout_ms) {
+    if (timeout_ms < 0) return IDLE_FRAME_BUDGET_NS;
+    uint64_t budget = (uint64_t)timeout_ms * 500000;
+    return budget < IDLE_FRAME_BUDGET_NS ? budget : IDLE_FRAME_BUDGET_NS;
+}
@@ -0,0 +1,58 @@
+/* idle.h - Work split up to run on the main thread between frames
+ *
+ * Some work has to run on the main thread (Lua, the document's rows) but
+ * need not run at once. An idle task is a step function called again
+ * and again, from the main loops once input has been handled and the
+ * frame drawn, for what is left of a strict budget (idle_run()). Each
+ * call does a piece of the work, looking at the deadline it is given as
+ * often as it can, and says whether there is more. Tasks take turns: a
+ * pass starts with the task after the last one called.
+ *
+ * Tasks belong to an owner (a buffer, a Lua state), and go when it does
+ * (idle_cancel_owner()). A task's 'done' function is called once, when
+ * it finishes or is cancelled, always after its last step has returned.
+ * Steps may add and cancel tasks, their own included.
+ */
+
+#ifndef LOKI_IDLE_H
+#define LOKI_IDLE_H
+
+#include <stdint.h>
+
+/* Most a pass of idle_run() gets, however long until the next frame */
+#define IDLE_FRAME_BUDGET_NS 2000000ULL
+
+/* What a step returns: IDLE_DONE or IDLE_MORE, with IDLE_DAMAGE if it
+ * changed what is on screen */
+enum {
+    IDLE_DONE = 0,
+    IDLE_MORE = 1,
+    IDLE_DAMAGE = 2
+};
+
+/* Do some of the work, returning by 'deadline' (uv_hrtime()) */
+typedef int (*IdleStep)(void *arg, uint64_t deadline);
+typedef void (*IdleDone)(void *arg);
+
+/* Add a task of 'owner'. 'done' (or NULL) is called with 'arg' when it
+ * finishes or is cancelled. Returns its id (> 0). */
+int idle_add(const void *owner, IdleStep step, IdleDone done, void *arg);
+
+/* Cancel a task. Returns 1 if it had not finished. */
+int idle_cancel(int id);
+
+/* Cancel every task of 'owner' */
+void idle_cancel_owner(const void *owner);
+
+/* Tasks not finished */
+int idle_pending(void);
+
+/* Call the tasks' steps, in turn, until 'budget_ns' has passed or none is
+ * left. Returns 1 if a step changed what is on screen, else 0. */
+int idle_run(uint64_t budget_ns);
+
+/* The budget for a pass 'timeout_ms' before the next frame is due (-1:
+ * none is): half that time, at most IDLE_FRAME_BUDGET_NS, none if 0. */
+uint64_t idle_budget(int timeout_ms);
+
+#endif /* LOKI_IDLE_H */
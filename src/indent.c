@@ -5,10 +5,22 @@
  * - Preserving indentation when pressing Enter
  * - Auto-indenting after opening braces/brackets
  * - Electric dedent when typing closing braces/brackets
- * - Smart detection of tabs vs spaces
+ * - Smart detection of tabs vs spaces, and of the indent width
+ * - Reindenting a range of lines by the brackets around them
+ *
+ * With a syntax tree whose language has an indent query (treesitter.h),
+ * lines are placed by the nodes around them instead, looked up in the
+ * tree for each line: no text is scanned. The bracket rules remain for
+ * other languages, and where the tree can't say.
  */
 
 #include "indent.h"
+#include "terminal.h"
+#include "undo.h"
+#ifdef LOKI_USE_LINENOISE
+#include "treesitter.h"
+#endif
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -48,6 +60,13 @@ void indent_set_width(editor_ctx_t *ctx, int width) {
     ctx->model.indent_config->width = width;
 }
 
+/* Set indentation style (INDENT_STYLE_SPACES or INDENT_STYLE_TABS) */
+void indent_set_style(editor_ctx_t *ctx, int style) {
+    if (!ctx->model.indent_config) return;
+    ctx->model.indent_config->style = style == INDENT_STYLE_TABS ? INDENT_STYLE_TABS
+                                                                 : INDENT_STYLE_SPACES;
+}
+
 /* Test-only accessor: get indentation width */
 int indent_get_width(editor_ctx_t *ctx) {
     if (!ctx->model.indent_config) return 0;
@@ -89,33 +108,67 @@ int indent_get_level(editor_ctx_t *ctx, int row) {
     return level;
 }
 
-/* Detect indentation style from file content.
- * Heuristic: count lines with leading tabs vs spaces.
- * Returns INDENT_STYLE_TABS or INDENT_STYLE_SPACES. */
-int indent_detect_style(editor_ctx_t *ctx) {
-    int tab_count = 0;
-    int space_count = 0;
-
-    /* Sample up to 100 lines to detect style */
-    int sample_size = ctx->model.numrows < 100 ? ctx->model.numrows : 100;
-
-    for (int i = 0; i < sample_size; i++) {
-        t_erow *row = &ctx->model.row[i];
-        if (row->size == 0) continue;
-
-        /* Check first character - if it's whitespace, count it */
-        if (row->chars[0] == '\t') {
-            tab_count++;
-        } else if (row->chars[0] == ' ') {
-            /* Count lines with 2+ leading spaces as space-indented */
-            if (row->size > 1 && row->chars[1] == ' ') {
-                space_count++;
+/* Detection samples INDENT_SAMPLE_STRATA runs of INDENT_SAMPLE_RUN
+ * consecutive lines, spread evenly over the file (all of a shorter one),
+ * so that a long file is judged by all of it, not by its head. */
+#define INDENT_SAMPLE_STRATA 16
+#define INDENT_SAMPLE_RUN 64
+
+/* Widths guessed from fewer steps between neighbouring lines are not
+ * trusted */
+#define INDENT_SAMPLE_MIN_STEPS 3
+
+int indent_detect(editor_ctx_t *ctx, int *style, int *width) {
+    int numrows = ctx->model.numrows;
+    int tab_count = 0, space_count = 0;
+    int steps[9] = {0};     /* Steps of 1..8 spaces between neighbours */
+
+    int strata = numrows > INDENT_SAMPLE_STRATA * INDENT_SAMPLE_RUN ? INDENT_SAMPLE_STRATA : 1;
+    for (int s = 0; s < strata; s++) {
+        int from = (int)((long long)s * numrows / strata);
+        int to = strata > 1 ? from + INDENT_SAMPLE_RUN : numrows;
+        int prev = -1;      /* Indent of the last non-blank line of the run */
+        for (int i = from; i < to; i++) {
+            const t_erow *row = &ctx->model.row[i];
+            int n = 0;
+            while (n < row->size && row->chars[n] == ' ') n++;
+            if (n == row->size) continue;   /* Blank */
+
+            if (row->chars[n] == '\t') {
+                tab_count++;
+                prev = -1;
+                continue;
             }
+            /* Lines with 2+ leading spaces count as space-indented */
+            if (n >= 2) space_count++;
+            int step = n > prev ? n - prev : prev - n;
+            if (prev >= 0 && step >= 1 && step <= 8) steps[step]++;
+            prev = n;
         }
     }
 
     /* If we found tabs, prefer tabs; otherwise spaces */
-    return (tab_count > space_count / 2) ? INDENT_STYLE_TABS : INDENT_STYLE_SPACES;
+    *style = (tab_count > space_count / 2) ? INDENT_STYLE_TABS : INDENT_STYLE_SPACES;
+    int best = 0;
+    for (int w = 2; w <= 8; w++)
+        if (steps[w] > steps[best]) best = w;
+    *width = steps[best] >= INDENT_SAMPLE_MIN_STEPS ? best : 0;
+    return tab_count + space_count > 0;
+}
+
+/* Detect indentation style from file content.
+ * Returns INDENT_STYLE_TABS or INDENT_STYLE_SPACES. */
+int indent_detect_style(editor_ctx_t *ctx) {
+    int style, width;
+    indent_detect(ctx, &style, &width);
+    return style;
+}
+
+void indent_adopt_detected(editor_ctx_t *ctx) {
+    int style, width;
+    if (!ctx->model.indent_config || !indent_detect(ctx, &style, &width)) return;
+    indent_set_style(ctx, style);
+    if (style == INDENT_STYLE_SPACES && width) indent_set_width(ctx, width);
 }
 
 /* Check if a character is an opening bracket/brace */
@@ -146,6 +199,27 @@ static int line_ends_with_opening(t_erow *row) {
     return 0;
 }
 
+/* Leading blanks of a row, in bytes */
+static int leading_blanks(const t_erow *row) {
+    int ws = 0;
+    while (ws < row->size && (row->chars[ws] == ' ' || row->chars[ws] == '\t')) ws++;
+    return ws;
+}
+
+#ifdef LOKI_USE_LINENOISE
+/* The indent the syntax tree gives the line at 'row' whose text starts at
+ * 'col', if the tree places it by the row above opening a construct or by
+ * the line closing one ('closing': a closing bracket typed). -1 if not. */
+static int tree_indent(editor_ctx_t *ctx, int row, int col, int closing) {
+    int anchor;
+    int res = treesitter_indent(ctx->model.ts_state, row, col, closing, &anchor);
+    if (res == TS_INDENT_SAME) return indent_get_level(ctx, anchor);
+    if (res == TS_INDENT_DEEPER && anchor == row - 1)
+        return indent_get_level(ctx, anchor) + ctx->model.indent_config->width;
+    return -1;
+}
+#endif
+
 /* Insert indentation at the current cursor position.
  * Respects the configured indentation style (tabs or spaces). */
 static void insert_indentation(editor_ctx_t *ctx, int level) {
@@ -182,18 +256,28 @@ void indent_apply(editor_ctx_t *ctx) {
     if (!ctx->model.indent_config->enabled) return;
     if (ctx->view.cy == 0) return;  /* No previous line */
 
-    /* Get indentation from previous line */
     int prev_row = ctx->view.cy - 1;
-    int base_indent = indent_get_level(ctx, prev_row);
-
-    /* Check if previous line ends with opening brace/bracket */
-    int extra_indent = 0;
-    if (line_ends_with_opening(&ctx->model.row[prev_row])) {
-        extra_indent = ctx->model.indent_config->width;
+    int total_indent = -1;
+#ifdef LOKI_USE_LINENOISE
+    /* The tree knows constructs without brackets (Python's "def f():"),
+     * and where the text moved down starts a closing one */
+    if (ctx->view.cy < ctx->model.numrows)
+        total_indent = tree_indent(ctx, ctx->view.cy,
+                                   leading_blanks(&ctx->model.row[ctx->view.cy]), 0);
+#endif
+    if (total_indent < 0) {
+        /* Get indentation from previous line */
+        int base_indent = indent_get_level(ctx, prev_row);
+
+        /* Check if previous line ends with opening brace/bracket */
+        int extra_indent = 0;
+        if (line_ends_with_opening(&ctx->model.row[prev_row])) {
+            extra_indent = ctx->model.indent_config->width;
+        }
+        total_indent = base_indent + extra_indent;
     }
 
     /* Insert the indentation */
-    int total_indent = base_indent + extra_indent;
     insert_indentation(ctx, total_indent);
 }
 
@@ -216,8 +300,13 @@ int indent_electric_char(editor_ctx_t *ctx, int c) {
         }
     }
 
-    /* Find matching opening bracket on previous lines to determine target indent */
+    /* The construct the bracket closes, from the tree; or find the
+     * matching opening bracket on previous lines */
     int target_indent = -1;
+#ifdef LOKI_USE_LINENOISE
+    target_indent = tree_indent(ctx, ctx->view.cy, ctx->view.cx, 1);
+    if (target_indent >= 0) goto found_match;
+#endif
     int match_char = get_matching_open(c);
     int depth = 1;  /* We're looking for the matching opening */
 
@@ -263,3 +352,181 @@ found_match:
 
     return 1;  /* Dedent was applied */
 }
+
+/* ======================== Reindenting ======================== */
+
+/* A bracket still open: the indent of the line that opened it, and of
+ * the lines inside it */
+typedef struct {
+    int outer, inner;
+} IndentOpen;
+
+/* Where a forward pass over the rows stands */
+typedef struct {
+    IndentOpen *open;
+    int depth, cap;
+    int in_comment;     /* Inside a multi-line comment */
+} IndentScan;
+
+/* The indent, in spaces, line 'row' should have as the scan stands;
+ * 'current' if no bracket is open or the line starts in a comment */
+static int line_target(const IndentScan *st, const t_erow *row, int ws, int current) {
+    if (st->in_comment || st->depth == 0) return current;
+    const IndentOpen *top = &st->open[st->depth - 1];
+    return is_closing_char(row->chars[ws]) ? top->outer : top->inner;
+}
+
+/* Follow the brackets of 'row', indented 'target', outside its strings
+ * and comments (as the buffer's syntax delimits them) */
+static void scan_line(IndentScan *st, const struct t_editor_syntax *syn,
+                      const t_erow *row, int target, int width) {
+    const char *sl = syn ? syn->singleline_comment_start : "";
+    const char *ms = syn ? syn->multiline_comment_start : "";
+    const char *me = syn ? syn->multiline_comment_end : "";
+    int sl_len = (int)strlen(sl), ms_len = (int)strlen(ms), me_len = (int)strlen(me);
+    int strings = !syn || (syn->flags & HL_HIGHLIGHT_STRINGS);
+    const char *c = row->chars;
+    int n = row->size;
+
+    for (int i = 0; i < n; i++) {
+        if (st->in_comment) {
+            if (me_len && i + me_len <= n && memcmp(c + i, me, me_len) == 0) {
+                st->in_comment = 0;
+                i += me_len - 1;
+            }
+            continue;
+        }
+        if (sl_len && i + sl_len <= n && memcmp(c + i, sl, sl_len) == 0) break;
+        if (ms_len && me_len && i + ms_len <= n && memcmp(c + i, ms, ms_len) == 0) {
+            st->in_comment = 1;
+            i += ms_len - 1;
+            continue;
+        }
+        if (strings && (c[i] == '"' || c[i] == '\'')) {
+            char quote = c[i];
+            for (i++; i < n && c[i] != quote; i++)
+                if (c[i] == '\\') i++;
+            continue;
+        }
+        if (is_opening_char(c[i])) {
+            if (st->depth == st->cap) {
+                st->cap = st->cap ? st->cap * 2 : 32;
+                IndentOpen *open = realloc(st->open, sizeof(*open) * (size_t)st->cap);
+                if (open == NULL) {
+                    perror("Out of memory");
+                    exit(1);
+                }
+                st->open = open;
+            }
+            st->open[st->depth].outer = target;
+            st->open[st->depth].inner = target + width;
+            st->depth++;
+        } else if (is_closing_char(c[i]) && st->depth > 0) {
+            st->depth--;
+        }
+    }
+}
+
+#ifdef LOKI_USE_LINENOISE
+/* The indents the syntax tree gives rows [first, last], parsed now if it
+ * was edited: lines follow the new indents of rows above them in the
+ * range. Blank rows, and rows the tree can't place, keep theirs. NULL if
+ * the language has no indent query. */
+static int *tree_targets(editor_ctx_t *ctx, int first, int last) {
+    TreeSitterState *ts = ctx->model.ts_state;
+    if (!ts || !treesitter_indent_ready(ts)) return NULL;
+    int from, to;
+    if (treesitter_sync_here(ts, &ctx->model, &from, &to)) {
+        for (int r = from; r < to; r++) ctx->model.row[r].hl_stale = 1;
+        if (from < ctx->model.hl_stale_from) ctx->model.hl_stale_from = from;
+    }
+    if (!ts->tree || ts->stale) return NULL;
+
+    int width = ctx->model.indent_config->width;
+    int *targets = malloc(sizeof(int) * (size_t)(last - first + 1));
+    if (targets == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int r = first; r <= last; r++) {
+        const t_erow *row = &ctx->model.row[r];
+        int ws = leading_blanks(row);
+        int current = indent_get_level(ctx, r);
+        int anchor = -1;
+        int res = ws == row->size ? TS_INDENT_UNKNOWN
+                                  : treesitter_indent(ts, r, ws, 0, &anchor);
+        int base = anchor >= first && anchor < r ? targets[anchor - first]
+                 : anchor >= 0 ? indent_get_level(ctx, anchor) : 0;
+        targets[r - first] = res == TS_INDENT_TOP ? 0
+                           : res == TS_INDENT_SAME ? base
+                           : res == TS_INDENT_DEEPER ? base + width
+                           : current;
+    }
+    return targets;
+}
+#endif
+
+int indent_reindent(editor_ctx_t *ctx, int first, int last) {
+    if (!ctx->model.indent_config) return 0;
+    if (first < 0) first = 0;
+    if (last >= ctx->model.numrows) last = ctx->model.numrows - 1;
+    if (first > last) return 0;
+
+    int width = ctx->model.indent_config->width;
+    int tabs = ctx->model.indent_config->style == INDENT_STYLE_TABS;
+    const struct t_editor_syntax *syn = ctx->view.syntax;
+    int cy = ctx->view.rowoff + ctx->view.cy, cx = ctx->view.coloff + ctx->view.cx;
+
+    int *targets = NULL;
+#ifdef LOKI_USE_LINENOISE
+    targets = tree_targets(ctx, first, last);
+#endif
+    IndentScan st = { NULL, 0, 0, 0 };
+    undo_rows_t undo = {0};
+    struct abuf line = ABUF_INIT;
+    int changed = 0;
+
+    /* By the tree, the range alone; by the brackets, one pass from the
+     * top: rows above the range only set the brackets open where it
+     * starts, at the indents they have */
+    for (int r = targets ? first : 0; r <= last; r++) {
+        t_erow *row = &ctx->model.row[r];
+        int ws = leading_blanks(row);
+        int current = indent_get_level(ctx, r);
+        int blank = ws == row->size;
+        int target = r < first || blank ? current
+                   : targets ? targets[r - first]
+                   : line_target(&st, row, ws, current);
+
+        if (r >= first) {
+            /* The indent the target asks for, in the configured style */
+            line.len = 0;
+            if (!blank) {
+                int n = tabs ? target / width : 0;
+                for (int i = 0; i < n; i++) terminal_buffer_append(&line, "\t", 1);
+                for (int i = tabs ? target % width : target; i > 0; i--)
+                    terminal_buffer_append(&line, " ", 1);
+            }
+            if (line.len != ws || (ws && memcmp(line.b, row->chars, (size_t)ws) != 0)) {
+                int lead = line.len;
+                terminal_buffer_append(&line, row->chars + ws, row->size - ws);
+                undo_rows_set(&undo, ctx, r, line.b ? line.b : "", line.len);
+                if (r == cy) cx += lead - ws;
+                changed++;
+            }
+        }
+        if (!blank && !targets) scan_line(&st, syn, row, target, width);
+    }
+
+    if (changed) undo_record_replace_rows(ctx, &undo);
+    undo_rows_free(&undo);
+    terminal_buffer_free(&line);
+    free(st.open);
+    free(targets);
+
+    if (changed && cy < ctx->model.numrows) {
+        int size = ctx->model.row[cy].size;
+        editor_cursor_to(ctx, cy, cx < 0 ? 0 : (cx > size ? size : cx));
+    }
+    return changed;
+}
@@ -3,8 +3,9 @@
  * This module provides automatic indentation features including:
  * - Copying indentation from previous line when pressing Enter
  * - Electric dedent for closing braces/brackets
- * - Tab/space style detection
+ * - Tab/space style and indent width detection
  * - Language-aware indentation rules
+ * - Reindenting lines by the brackets around them
  */
 
 #ifndef LOKI_INDENT_H
@@ -35,6 +36,30 @@ int indent_get_level(editor_ctx_t *ctx, int row);
  * Uses heuristic: count lines with leading tabs vs spaces. */
 int indent_detect_style(editor_ctx_t *ctx);
 
+/* Detect the style and the indent width, from runs of lines sampled over
+ * the whole file: the width is the step between neighbouring lines seen
+ * most often (2..8), or 0 if too few were seen to tell. Returns 0 if no
+ * sampled line is indented at all. */
+int indent_detect(editor_ctx_t *ctx, int *style, int *width);
+
+/* Set the configured style, and width if detected, from the buffer.
+ * Called when a file is opened. A buffer with no indentation keeps the
+ * configuration it has. */
+void indent_adopt_detected(editor_ctx_t *ctx);
+
+/* Reindent rows first..last in one pass: each line inside brackets gets
+ * one level (config width) more than the line that opened the innermost
+ * of them, or that line's indent if it starts with the closer. Brackets
+ * in strings and comments (as the buffer's syntax delimits them) do not
+ * count. Lines outside any bracket, and lines starting inside a
+ * multi-line comment, keep their indent; blank lines lose theirs.
+ * Buffers whose tree-sitter grammar has an indent query are reindented
+ * by their syntax tree instead (see treesitter_indent()), with these
+ * rules for lines the tree can't place.
+ * Only lines whose leading whitespace changes are rewritten, as one undo
+ * step. Returns the number of lines changed. */
+int indent_reindent(editor_ctx_t *ctx, int first, int last);
+
 /* Apply indentation to current line based on previous line.
  * Called when user presses Enter - copies indentation from previous line.
  * If previous line ends with opening brace/bracket, adds one level.
@@ -59,6 +84,10 @@ void indent_set_enabled(editor_ctx_t *ctx, int enabled);
  * Can be called from Lua or command mode. */
 void indent_set_width(editor_ctx_t *ctx, int width);
 
+/* Set indentation style (INDENT_STYLE_SPACES or INDENT_STYLE_TABS), as
+ * new indents and reindenting write them. */
+void indent_set_style(editor_ctx_t *ctx, int style);
+
 /* Test-only accessors for indent_config fields (opaque structure) */
 int indent_get_width(editor_ctx_t *ctx);
 int indent_get_enabled(editor_ctx_t *ctx);
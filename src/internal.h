@@ -9,6 +9,7 @@
 #define LOKI_INTERNAL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <signal.h>
 #include <lua.h>
@@ -35,6 +36,8 @@
 #define HL_TYPE_MARKDOWN 1
 #define HL_TYPE_CSOUND 2
 #define HL_TYPE_TREESITTER 3
+#define HL_TYPE_GENERATED 4     /* HL_TYPE_C rules, compiled at build time
+                                   into t_editor_syntax.scan */
 
 /* Code block language constants (for markdown) */
 #define CB_LANG_NONE 0
@@ -62,11 +65,14 @@ enum KEY_ACTION{
         TAB = 9,            /* Tab */
         CTRL_L = 12,        /* Ctrl+l */
         ENTER = 13,         /* Enter */
+        CTRL_N = 14,        /* Ctrl-n (complete word) */
         CTRL_P = 16,        /* Ctrl-p (play file) */
         CTRL_Q = 17,        /* Ctrl-q */
+        CTRL_R = 18,        /* Ctrl-r (regex search) */
         CTRL_S = 19,        /* Ctrl-s */
         CTRL_T = 20,        /* Ctrl-t */
         CTRL_U = 21,        /* Ctrl-u */
+        CTRL_V = 22,        /* Ctrl-v (visual block) */
         CTRL_W = 23,        /* Ctrl-w */
         CTRL_X = 24,        /* Ctrl-x */
         ESC = 27,           /* Escape */
@@ -86,7 +92,9 @@ enum KEY_ACTION{
         END_KEY,
         PAGE_UP,
         PAGE_DOWN,
-        SHIFT_RETURN
+        SHIFT_RETURN,
+        PASTE_KEY,          /* Bracketed paste, see terminal_paste() */
+        MOUSE_KEY           /* Mouse report, see terminal_mouse() */
 };
 
 /* ======================= Configuration Constants ========================== */
@@ -94,8 +102,9 @@ enum KEY_ACTION{
 #define KILO_QUERY_LEN 256
 #define STATUS_ROWS 2
 
-#define LUA_REPL_HISTORY_MAX 64
 #define LUA_REPL_LOG_MAX 128
+#define LUA_REPL_COMPLETIONS_SHOWN 5    /* Matches listed on Tab */
+#define LUA_REPL_BUFFER_WORD_MIN 3      /* Shortest buffer word completed */
 #define LUA_REPL_OUTPUT_ROWS 2
 #define LUA_REPL_TOTAL_ROWS (LUA_REPL_OUTPUT_ROWS + 1)
 #define LUA_REPL_PROMPT ">> "
@@ -104,6 +113,7 @@ enum KEY_ACTION{
 
 /* Undo/redo state - opaque pointer, defined in loki_undo.c */
 struct undo_state;
+struct RecoveryJournal;
 
 /* Shared audio/MIDI/Link context - see shared/context.h */
 struct SharedContext;
@@ -111,6 +121,13 @@ struct SharedContext;
 /* Tree-sitter state - opaque pointer, defined in treesitter.c */
 struct TreeSitterState;
 
+/* Highlight runs - see hl_spans.h */
+struct HlSpanBlock;
+struct HlSpans;
+
+/* Input history kept on disk - see history.h */
+struct HistoryLog;
+
 /* Language state forward declarations - see src/lang_config.h */
 #include "lang_config.h"
 
@@ -131,20 +148,122 @@ struct t_editor_syntax {
     char *separators;
     int flags;
     int type;  /* HL_TYPE_* */
+    struct KeywordTable *kwtable;  /* keywords and byte classes compiled for
+                                      lookup, or NULL (see
+                                      syntax_compile_keywords()) */
+    void (*scan)(struct t_erow *row, int in_comment);
+                                   /* HL_TYPE_GENERATED: the highlighter
+                                      generated from these rules (see
+                                      syntax/builtin.h) */
 };
 
-/* This structure represents a single line of the file we are editing. */
+/* Row buffers, used as t_erow.arena_bufs bits and editor_row_reserve()
+ * selectors. */
+#define ROW_BUF_CHARS  (1<<0)
+#define ROW_BUF_RENDER (1<<1)
+#define ROW_BUF_HL     (1<<2)
+
+/* t_erow.arena_bufs bit: chars points into the model's mapped snapshot or
+ * file (model.row_map, see editor_model_map_snapshot() and editor_open()),
+ * read-only. A row writing to them gets a copy first (editor_row_reserve()). */
+#define ROW_BUF_MAPPED (1<<3)
+
+/* t_erow.arena_bufs bit: render is chars itself, the row having no TABs to
+ * expand (see editor_row_render()). It has no buffer of its own until one
+ * is reserved for it, and follows chars when they move. */
+#define ROW_BUF_ALIAS  (1<<4)
+
+/* t_erow.arena_bufs bit: the row's highlight is packed into runs,
+ * hl_spans, rather than a byte per render column (see
+ * editor_row_pack_hl()). The block is malloc'd; hl_cap is 0 meanwhile. */
+#define ROW_BUF_SPANS  (1<<5)
+
+/* Long rows (minified JS, JSON dumps): a row of at least ROW_LONG_MIN
+ * chars keeps render/hl only for a window of about ROW_LONG_WINDOW render
+ * columns, starting at render column render_off, and finds columns through
+ * a chunked index instead of expanding the whole line. Editing or scrolling
+ * such a row costs O(window), not O(line). The window is moved by
+ * editor_visible_row(); highlighting restarts at the window's start. */
+#define ROW_LONG_MIN    65536
+#define ROW_LONG_WINDOW 8192
+#define ROW_LONG_CHUNK  4096
+
+/* colindex->col[k] is the render column of chars[k * ROW_LONG_CHUNK]; the
+ * first 'valid' entries are up to date. */
+typedef struct t_colindex {
+    int valid;
+    int cap;
+    int col[];
+} t_colindex;
+
+/* Row contents shared between a row and undo snapshots (see
+ * undo_rows_set()), read-only while shared. A row writing to them gets a
+ * copy first (editor_row_reserve()); the block goes back to its arena,
+ * or the heap, or lets go of its mapping, when the last holder lets go. */
+typedef struct RowShare {
+    int refs;
+    int len;            /* Bytes of contents, excluding the null term. */
+    int cap;            /* Bytes allocated (0 if unknown). */
+    char *chars;
+    struct RowArena *arena;   /* Holding the block (retained), or NULL */
+    struct RowMap *map;       /* Or the mapping holding it (retained) */
+} RowShare;
+
+/* A snapshot or file mapped rows point into (ROW_BUF_MAPPED), held by the
+ * model and by shares of those rows, and unmapped when the last of them
+ * lets go. */
+typedef struct RowMap {
+    int refs;
+    void *base;
+    size_t len;
+} RowMap;
+
+/* This structure represents a single line of the file we are editing.
+ * Rows are drawn, searched and highlighted far more often than they are
+ * resized or snapshotted, so the fields every pass reads come first and
+ * share a cache line; the bookkeeping follows. Flags and per-language
+ * state fit in bytes. */
 typedef struct t_erow {
-    int idx;            /* Row index in the file, zero-based. */
+    char *chars;        /* Row content. */
+    char *render;       /* Row content "rendered" for screen (for TABs);
+                           chars itself without them, NULL until built
+                           (see editor_row_render()). */
+    union {
+        unsigned char *hl;  /* Syntax highlight type for each character in
+                               render. */
+        struct HlSpanBlock *hl_spans; /* The same as runs, with
+                                         ROW_BUF_SPANS. */
+    } hl_buf;
     int size;           /* Size of the row, excluding the null term. */
     int rsize;          /* Size of the rendered row. */
-    char *chars;        /* Row content. */
-    char *render;       /* Row content "rendered" for screen (for TABs). */
-    unsigned char *hl;  /* Syntax highlight type for each character in render.*/
-    int hl_oc;          /* Row had open comment at end in last syntax highlight
-                           check. */
-    int cb_lang;        /* Code block language (for markdown): CB_LANG_* */
-    int csd_section;    /* CSD section (for Csound): CSD_SECTION_* */
+    int render_off;     /* Render column of render[0]; 0 unless long. */
+    unsigned char hl_oc;     /* Row had open comment at end in last syntax
+                                highlight check. */
+    unsigned char hl_stale;  /* hl must be recomputed before use; see
+                                syntax_fresh_row(). */
+    unsigned char hl_hooked; /* The row hook saw hl since it was
+                                recomputed; see syntax_set_row_hook(). */
+    unsigned char arena_bufs; /* ROW_BUF_* bits of buffers owned by
+                                model.arena. */
+    unsigned long damage_gen; /* model.damage_gen of the last visible change
+                           (0: unknown, always redrawn). */
+    t_colindex *colindex; /* Long rows only, else NULL (malloc'd). */
+    RowShare *share;    /* Set while chars is shared (copy on write). */
+    unsigned long edit_gen; /* model.edit_gen when chars last changed, or
+                           when the row was made. */
+    int chars_cap;      /* Bytes allocated for chars (0 if unknown). */
+    int render_cap;     /* Bytes allocated for render (0 if unknown). */
+    int hl_cap;         /* Bytes allocated for hl (0 if unknown). */
+    int snap_row;       /* Row index in the last checkpoint (see
+                           snapshot_checkpoint_write()), if edit_gen is
+                           not past model.snap_gen. */
+    unsigned char cb_lang;     /* Code block language (for markdown):
+                                  CB_LANG_* */
+    unsigned char cb_entry;    /* cb_lang in effect above the row when
+                                  highlighted */
+    unsigned char csd_section; /* CSD section (for Csound): CSD_SECTION_* */
+    int count_words;    /* Words of the row in model.count_words, while it
+                           is kept (see editor_model_counts()). */
 } t_erow;
 
 /* Lua REPL state */
@@ -152,30 +271,115 @@ typedef struct t_lua_repl {
     char input[KILO_QUERY_LEN+1];
     int input_len;
     int active;
-    int history_len;
-    int history_index;
-    char *history[LUA_REPL_HISTORY_MAX];
+    struct HistoryLog *history; /* .loki/lua_history.log, opened when first used */
+    int history_index;          /* Entries back from the newest shown, -1 for none */
+    int history_search_len;     /* Bytes Ctrl-R matches entries on */
     int log_len;
     char *log[LUA_REPL_LOG_MAX];
+    struct CompletionIndex *completions; /* Tab completion (completion.h), or NULL */
+    int completions_stale;      /* Globals changed since it was synced */
+    const struct EditorModel *completions_model; /* Buffer its words are from */
+    unsigned long completions_gen; /* That buffer's damage_gen then */
 } t_lua_repl;
 
 /* Lua host */
+/* Modes of Lua keymaps (loki.keymap()). Each maps key codes below
+ * LUA_KEYMAP_KEYS, which every code parse_key_notation() gives is. */
+enum { LUA_KEYMAP_NORMAL, LUA_KEYMAP_INSERT, LUA_KEYMAP_VISUAL, LUA_KEYMAP_COMMAND,
+       LUA_KEYMAP_MODES };
+#define LUA_KEYMAP_KEYS 1100
+
+/* Keymap callbacks by mode and key code, as registry references
+ * (LUA_NOREF: not mapped), so dispatching a key is an array read */
+typedef struct LuaKeymaps {
+    int refs[LUA_KEYMAP_MODES][LUA_KEYMAP_KEYS];
+} LuaKeymaps;
+
 typedef struct LuaHost {
     lua_State *L;
     t_lua_repl repl;
+    struct HighlightHookCache *hl_cache;  /* highlight hook results, or NULL */
+    struct Regexp *search_re; /* loki.search(): last pattern compiled */
+    char *search_src;         /* Its source, after literal escaping */
+    int search_flags;
+    struct AiContext *ai_context; /* loki.ai_context(): rows escaped, or NULL */
+    LuaKeymaps *keymaps;      /* Built by the first loki.keymap(), or NULL */
 } LuaHost;
 
 /* ======================= Model/View Separation ============================= */
 
+/* Allocation counters for row storage. Each field counts calls into the
+ * allocator (malloc/realloc) for that kind of buffer, so the effect of
+ * capacity-based growth can be measured. */
+typedef struct EditorAllocStats {
+    unsigned long row_array;  /* Reallocations of model.row */
+    unsigned long chars;      /* Allocations of row->chars */
+    unsigned long render;     /* Allocations of row->render */
+    unsigned long hl;         /* Allocations of row->hl_buf.hl */
+} EditorAllocStats;
+
+/* Languages resolved for model.filename by loki_lang_resolve(). */
+typedef struct EditorLang {
+    const char *filename;     /* model.filename they were resolved for */
+    unsigned long gen;        /* loki_lang_generation() then, 0: stale */
+    const struct LokiLangOps *ops;        /* Language bridge entry or NULL */
+    struct t_editor_syntax *syntax;       /* Highlighting rules or NULL */
+    const char *ts_lang;      /* Tree-sitter grammar name or NULL */
+} EditorLang;
+
 /* EditorModel - Document state that persists across views.
  * Contains buffer content, file metadata, and language-specific state.
- * Multiple views can share the same model in future implementations. */
+ * Buffers on the same document share one model (see buffers.c), each
+ * with its own view swapped into the context when shown. */
 typedef struct EditorModel {
     t_erow *row;              /* Buffer content (rows) */
     int numrows;              /* Number of rows */
+    int rowcap;               /* Allocated slots in row (0 if unknown) */
+    EditorAllocStats alloc_stats;         /* Row storage allocation counters */
+    struct RowArena *arena;   /* Slab for row buffers (NULL: plain heap) */
+    struct RowMap *row_map;   /* Snapshot or file mapped rows point into */
+    int hl_stale_from;        /* Rows above this one have up-to-date hl */
+    int hl_pending;           /* syntax_fresh_rows() ran out of time */
+    int hl_idle;              /* Idle task catching up (0: none) */
+    int hl_idle_to;           /* Row it catches up to */
+    struct FenceIndex *fences; /* Markdown code fences (NULL: not built) */
+    struct SaveJob *save_job; /* Async save reading the rows (NULL if none) */
+    struct SearchIndex *search_index;     /* Row trigrams (NULL: not indexed) */
+    struct loki_markdown_cache *md_cache; /* Markdown AST (NULL: not built) */
+    struct DecorLayer *decor; /* Overlays on the text (NULL: none yet) */
+    struct MarkSet *marks;    /* Positions kept across edits (NULL: none yet) */
+    struct FoldSet *folds;    /* Code folds (NULL: none yet) */
+    struct WrapCache *wrap;   /* Soft wrap breaks of rows shown (NULL: none yet) */
+    struct ColumnIndex *columns; /* Fields of rows, in column mode (NULL: off) */
+    struct Ghost *ghost;      /* Suggestion drawn inline (NULL: none) */
+    struct Utf8Cols *utf8_cols; /* Cell checkpoints of rows shown (NULL: none yet) */
+    struct LazyFile *lazy;    /* File rows are a window of (NULL: all loaded) */
+    struct FollowFile *follow; /* File read as it grows (NULL: not followed) */
+    struct FileWatch *watch;   /* Changes to the file on disk (NULL: none) */
+    struct DiffView *diff;     /* :diff this buffer is in (NULL: none) */
+    struct FilterJob *filter;  /* Command rows are filtered through (NULL: none) */
+    struct LspDoc *lsp;        /* Its file open in a language server (NULL: none) */
+    struct ChangeLog *changes; /* Watches of its edits (NULL: none) */
+    struct WordIndex *words;  /* Its words, for Ctrl-N (NULL: not indexed) */
+    int spell;                /* Misspelt words of rows shown decorated (spell.h) */
+    struct EditorSnapshot *snapshot;      /* Latest, while held (not a reference;
+                                           * see model_snapshot.h), or NULL */
+    unsigned long damage_gen; /* Bumped by every change a view can see */
+    int shift_from;           /* Rows from here moved since shift_base */
+    unsigned long shift_base; /* damage_gen when shift_from was reset */
+    unsigned long edit_gen;   /* Stamped on rows as they change; bumped by
+                               * each checkpoint */
+    unsigned long snap_gen;   /* edit_gen of the last checkpoint (0: none
+                               * since the rows were replaced) */
+    int counts_kept;          /* count_bytes/words are kept as rows change
+                               * (0: counted when next asked for) */
+    long long count_bytes;    /* Bytes of the text, a newline after each row */
+    long long count_words;    /* Words of the rows */
     char *filename;           /* Currently open filename */
+    EditorLang lang;          /* Its languages; gen = 0 when it changes */
     int dirty;                /* File modified but not saved */
     struct undo_state *undo_state;        /* Undo/redo state (NULL if disabled) */
+    struct RecoveryJournal *recovery;     /* Its unsaved edits on disk (NULL: none) */
     struct indent_config *indent_config;  /* Auto-indent settings */
 
     /* Shared audio/MIDI/Link context - single instance for all languages.
@@ -193,6 +397,11 @@ typedef struct EditorModel {
 #endif
 } EditorModel;
 
+/* A document position of one of a view's extra cursors */
+typedef struct CursorPos {
+    int row, col;
+} CursorPos;
+
 /* EditorView - Presentation state that is terminal/viewport-specific.
  * Contains cursor position, viewport offset, display settings, and UI state.
  * Each view has its own cursor, scroll position, and mode. */
@@ -213,12 +422,38 @@ typedef struct EditorView {
     int sel_active;           /* Selection active flag */
     int sel_start_x, sel_start_y;  /* Selection start position */
     int sel_end_x, sel_end_y;      /* Selection end position */
+    int sel_block;            /* Visual block: the rectangle between the two
+                               * positions, both columns included */
+    int sel_grown;            /* Last grown to a syntax node (visual +), */
+    int sel_origin_x, sel_origin_y;  /* from here, where - shrinks to */
+
+    /* Cursors besides (cx, cy), in document order (see multicursor.h) */
+    CursorPos *cursors;
+    int cursor_count, cursor_cap;
+    unsigned int cursors_gen; /* Changed whenever the cursors do */
+    int vmark_set;            /* A visual selection has ended with ':' ... */
+    int vmark_start, vmark_end;    /* ... on these rows ('< and '>, marks
+                                    * in model.marks) */
 
     /* Display settings */
     struct t_editor_syntax *syntax;  /* Current syntax highlight, or NULL */
     t_hlcolor colors[9];      /* Syntax highlight colors: indexed by HL_* constants */
+    char color_sgr[9][20];    /* colors[] as ready escape sequences ... */
+    unsigned char color_sgr_len[9];
+    int color_sgr_valid;      /* ... 0: rebuild them before use */
     int line_numbers;         /* Line numbers display flag */
     int word_wrap;            /* Word wrap enabled flag */
+    int hl_search;            /* Search marks every match, shows "n of N" */
+    int ignore_case;          /* Searches ignore case ... */
+    int smart_case;           /* ... unless the query has upper case */
+
+    /* Values derived for drawing, recomputed only when their inputs change
+     * (editor_gutter_width(), editor_lang_label()) */
+    int gutter_digits;        /* Digits in the line count ... */
+    int gutter_lo, gutter_hi; /* ... while gutter_lo <= numrows < gutter_hi */
+    int lang_valid;           /* 0: lang_label is stale */
+    const struct LokiLangOps *lang_ops;   /* Language lang_label names */
+    char lang_label[16];      /* lang_ops->name upper-cased, plus a space */
 
     /* Modal state */
     EditorMode mode;          /* Current editor mode (normal/insert/visual/command) */
@@ -226,13 +461,38 @@ typedef struct EditorView {
     int cmd_length;           /* Length of command */
     int cmd_cursor_pos;       /* Cursor position in command */
     int cmd_history_index;    /* Current history position */
+    int cmd_search_len;       /* Bytes Ctrl-R matches history entries on */
     int pending_prefix;       /* Pending prefix key (e.g., CTRL_X for Ctrl-X sequences), 0 if none */
+    int count;                /* Count typed so far in normal mode, 0 if none */
+    int op_count;             /* Count typed before a pending operator ('d') */
 
     /* Status */
     char statusmsg[80];       /* Status message */
     time_t statusmsg_time;    /* Status message timestamp */
 } EditorView;
 
+/* What a view drew in its last frame: with the model's damage stamps this
+ * tells which screen rows can be repeated instead of re-segmented. */
+typedef struct ViewFrame {
+    int valid;                /* A frame was drawn with these settings */
+    const void *target;       /* Renderer or session the frame went to */
+    int rowoff, coloff;       /* Viewport of the frame */
+    int rows;                 /* Text rows drawn */
+    int text_cols;            /* Columns of text per row */
+    int gutter_width;         /* Line number gutter width */
+    unsigned long gen;        /* model.damage_gen after drawing */
+    int sel_active;           /* Selection, normalized start <= end */
+    int sel_start_y, sel_start_x, sel_end_y, sel_end_x;
+    int sel_block;
+    unsigned int cursors_gen; /* Extra cursors, shown on rows first..last */
+    int cursor_first, cursor_last;
+    int rows_rebuilt;         /* Rows segmented for the frame (statistics) */
+    unsigned long fold_gen;   /* fold_gen() of the folds shown */
+    int screen_top;           /* fold_screen_row() of rowoff */
+    int wrapped;              /* A row shown was wrapped: rows are not
+                               * where fold_screen_row() puts them */
+} ViewFrame;
+
 /* Editor context - one instance per editor viewport/buffer.
  * This structure will enable multiple independent editor contexts for future
  * split windows and multiple buffers implementation.
@@ -248,8 +508,65 @@ struct editor_ctx {
     EditorView view;          /* Presentation state (cursor, viewport, UI) */
     LuaHost *lua_host;        /* Lua host */
     Renderer *renderer;       /* Rendering abstraction (may be NULL for direct VT100) */
+    ViewFrame frame;          /* Last frame drawn through renderer */
 };
 
+/* ======================= Row Accessors ==================================== */
+/* Modules outside core.c should reach document lines through these accessors
+ * rather than indexing model.row directly. Keeping the row storage behind a
+ * single seam lets core.c change how lines are stored (chunked arrays, a
+ * rope, lazily materialized rows) without touching every consumer.
+ *
+ * model_row() returns NULL for out-of-range indices, so callers can fold the
+ * bounds check into the lookup. model_row_index() goes the other way: a row
+ * does not store its own position, it is derived from the row's address, so
+ * inserting or deleting a line never renumbers the rows after it. */
+static inline int model_numrows(const EditorModel *model) {
+    return model->numrows;
+}
+
+static inline t_erow *model_row(const EditorModel *model, int at) {
+    if (at < 0 || at >= model->numrows) return NULL;
+    return &model->row[at];
+}
+
+/* Zero-based position of 'row' in the model, or -1 if it is not one of the
+ * model's rows (e.g. a scratch row being highlighted on its own). */
+static inline int model_row_index(const EditorModel *model, const t_erow *row) {
+    uintptr_t base = (uintptr_t)model->row, p = (uintptr_t)row;
+    if (model->row == NULL || p < base) return -1;
+    if ((p - base) % sizeof(t_erow) != 0) return -1;
+    size_t at = (p - base) / sizeof(t_erow);
+    if (at >= (size_t)model->numrows) return -1;
+    return (int)at;
+}
+
+/* Damage tracking: views remember which rows they drew (ViewFrame) and
+ * skip rebuilding the ones that did not change. A row's damage_gen is
+ * stamped when its render or highlight changes; inserting or deleting
+ * rows only lowers model.shift_from, since every row below moved. */
+static inline void editor_row_damage(EditorModel *model, t_erow *row) {
+    row->damage_gen = ++model->damage_gen;
+}
+
+/* Forget the view's derived display values; call when the filename or its
+ * language may have changed. */
+static inline void editor_view_reset_derived(EditorView *view) {
+    view->gutter_lo = view->gutter_hi = 0;
+    view->lang_valid = 0;
+    view->lang_ops = NULL;
+    view->lang_label[0] = '\0';
+}
+
+static inline void editor_model_damage_shift(EditorModel *model, int from) {
+    if (from < model->shift_from) model->shift_from = from;
+    model->damage_gen++;
+}
+
+#define editor_numrows(ctx) model_numrows(&(ctx)->model)
+#define editor_row(ctx, at) model_row(&(ctx)->model, (at))
+#define editor_row_index(ctx, row) model_row_index(&(ctx)->model, (row))
+
 /* ======================= Compatibility Macros ============================== */
 /* These macros provide backwards compatibility during the migration period.
  * They allow existing code to continue using ctx->field syntax while we
@@ -301,9 +618,10 @@ typedef editor_ctx_t loki_editor_instance;
 struct abuf {
     char *b;
     int len;
+    int cap;    /* Bytes allocated; grows geometrically, never shrinks */
 };
 
-#define ABUF_INIT {NULL,0}
+#define ABUF_INIT {NULL,0,0}
 
 /* Screen buffer functions are now in loki_terminal.h */
 
@@ -317,13 +635,308 @@ void editor_ctx_set_renderer(editor_ctx_t *ctx, Renderer *renderer);
 /* Status message */
 void editor_set_status_msg(editor_ctx_t *ctx, const char *fmt, ...);
 
+/* Is the buffer read-only, as a large file (lazy.h), one followed
+ * (follow.h) or one being filtered (filter.h)? Then says so in the
+ * status. Edits and saves check it. */
+int editor_refuse_edit(editor_ctx_t *ctx);
+
 /* Character insertion (context-aware) */
 void editor_insert_char(editor_ctx_t *ctx, int c);
 void editor_insert_newline(editor_ctx_t *ctx);
+void editor_insert_text(editor_ctx_t *ctx, const char *text, size_t len);
 void editor_del_char(editor_ctx_t *ctx);
 
 /* Row management (test helpers) */
 void editor_insert_row(editor_ctx_t *ctx, int at, char *s, size_t len);
+void editor_del_row(editor_ctx_t *ctx, int at);
+void editor_del_rows(editor_ctx_t *ctx, int at, int n);
+
+/* Append 'len' bytes to the end of a row. */
+void editor_row_append_string(editor_ctx_t *ctx, t_erow *row, char *s, size_t len);
+
+/* Replace the contents of a row (bulk edits such as :%s). The change is
+ * not recorded for undo; see undo_record_replace_rows(). */
+void editor_row_set(editor_ctx_t *ctx, t_erow *row, const char *s, size_t len);
+
+/* Share a row's contents, taking a reference the caller releases with
+ * editor_row_share_release(); the row keeps reading them until it is
+ * written to. O(1): nothing is copied. */
+RowShare *editor_row_share(EditorModel *model, t_erow *row);
+void editor_row_share_release(RowShare *share);
+
+/* Hold the 'len' bytes mapped at 'base' for rows to point into; the model
+ * keeps it as model.row_map. It is unmapped by the last release. */
+RowMap *editor_row_map_new(void *base, size_t len);
+void editor_row_map_release(RowMap *map);
+
+/* Like editor_row_set(), with the row taking a reference to shared
+ * contents instead of a copy. */
+void editor_row_set_shared(editor_ctx_t *ctx, t_erow *row, RowShare *share);
+
+/* Replace the text from (row, col) up to (end_row, end_col) with the 'len'
+ * bytes at 'text', which may hold newlines, moving the rows below at most
+ * once. Positions are clamped to the document and may come in either
+ * order. The edit is recorded for undo as one entry in a group of its own
+ * (see undo_record_replace_range()). The end of the inserted text goes to
+ * *out_row, *out_col when not NULL. Returns the bytes removed, newlines
+ * included. */
+int editor_replace_range(editor_ctx_t *ctx, int row, int col, int end_row,
+                         int end_col, const char *text, size_t len,
+                         int *out_row, int *out_col);
+
+/* Replace rows first..last by the 'count' of them at first + order[i]
+ * (each at most once: rows left out are deleted), moving the rows rather
+ * than their text. Recorded for undo as one entry, as editor_replace_range()
+ * would record the same edit. Returns 'count', or 0 if refused. */
+int editor_permute_rows(editor_ctx_t *ctx, int first, int last,
+                        const int *order, int count);
+
+/* Delete the text from (row, col) up to (end_row, end_col) in one splice:
+ * the rows between are freed and the rows below moved once, the two ends
+ * joined, and one undo entry recorded. As editor_replace_range() with no
+ * text; the start of the range, clamped and in order, goes to *out_row,
+ * *out_col when not NULL. Returns the bytes removed, newlines included. */
+int editor_delete_range(editor_ctx_t *ctx, int row, int col, int end_row,
+                        int end_col, int *out_row, int *out_col);
+
+/* Put the cursor at document position (row, col), scrolling the view to
+ * it if needed */
+void editor_cursor_to(editor_ctx_t *ctx, int row, int col);
+
+/* Scroll the view so that shown row 'row' is on screen, and put the
+ * cursor on it. Rows in closed folds take no screen rows; with word wrap,
+ * a row takes as many as it is wrapped on. */
+void editor_scroll_to_row(editor_ctx_t *ctx, int row);
+
+/* After the cursor, the folds or the wrap moved: put the cursor on the
+ * head of the closed fold hiding it, if one does, and scroll it back on
+ * screen. On a wrapped row the cursor's column is kept in cx, coloff 0. */
+void editor_view_fix(editor_ctx_t *ctx);
+
+/* Grow a row buffer (chars, render or hl) to hold at least 'need' bytes.
+ * The first allocation is exact; later growth doubles the capacity so that
+ * byte-at-a-time edits cost amortized O(1) allocations. *cap is updated and
+ * *allocs incremented when the allocator is called. Exits on out of memory.
+ * Returns the (possibly moved) buffer. */
+void *editor_buf_reserve(void *buf, int *cap, size_t need, unsigned long *allocs);
+
+/* editor_open() on a file already mapped and indexed by loader.c, as a
+ * worker thread may do beforehand: creates the rows and releases 'file'
+ * and 'index' either way. Returns 0 on success or -1 on error. */
+struct LoadedFile;
+struct LineIndex;
+int editor_open_loaded(editor_ctx_t *ctx, const char *filename,
+                       struct LoadedFile *file, struct LineIndex *index);
+
+/* Append a row for every line of 'index' into 'file', as editor_open()
+ * creates them (on worker threads for many lines). Releases neither. */
+void editor_append_lines(editor_ctx_t *ctx, const struct LoadedFile *file,
+                         const struct LineIndex *index);
+
+/* Give the model a row arena (no-op if it has one, or when built with
+ * LOKI_NO_ROW_ARENA). Row buffers of a model without an arena are plain
+ * heap blocks that callers may free() themselves, but for a render that
+ * is chars (ROW_BUF_ALIAS). */
+void editor_model_use_arena(EditorModel *model);
+
+/* Like editor_buf_reserve() for one of a row's buffers (a ROW_BUF_*
+ * selector), allocating from the model's arena if it has one. Blocks of unknown size
+ * that were allocated elsewhere keep growing on the heap. Returns the
+ * buffer, which is also stored in the row. */
+void *editor_row_reserve(EditorModel *model, t_erow *row, int which,
+                         size_t need, unsigned long *allocs);
+
+/* Build the render of a row that has none yet: one from a snapshot, or
+ * left for when it is first read by editor_set_render_on_demand(). Rows
+ * without TABs get chars itself (ROW_BUF_ALIAS). The highlight is left
+ * as it is, so an unrendered row must be stale. */
+void editor_row_render(EditorModel *model, t_erow *row, EditorAllocStats *stats);
+
+/* Render on demand (default off): rows with TABs read from files are
+ * rendered when first drawn or highlighted rather than as they are read.
+ * Rows without TABs are never copied, whatever this says. */
+void editor_set_render_on_demand(int on);
+int editor_get_render_on_demand(void);
+
+/* Pack a freshly highlighted row's hl into runs (ROW_BUF_SPANS) when they
+ * take less than half the bytes do. */
+void editor_row_pack_hl(EditorModel *model, t_erow *row);
+
+/* The row's highlight as a byte per render column, unpacking it (into a
+ * heap block) if it is packed. NULL if the row has none. */
+unsigned char *editor_row_hl(t_erow *row);
+
+/* Highlight of render column 'col' (relative to render_off), whichever
+ * way it is stored. */
+unsigned char editor_row_hl_at(const t_erow *row, int col);
+
+/* Copy the highlight of render columns [from, from+len) to 'out' as
+ * bytes, without unpacking the row. */
+void editor_row_hl_read(const t_erow *row, int from, int len,
+                        unsigned char *out);
+
+/* Append the highlight runs of render columns [from, from+len) to
+ * 'spans', with starts relative to 'from'. A row without a highlight is
+ * one HL_NORMAL run. */
+void editor_row_hl_spans(const t_erow *row, int from, int len,
+                         struct HlSpans *spans);
+
+/* Collect the runs to draw render columns [from, from+len) of row
+ * 'filerow' with: its highlight, with its decorations (see decor.h) over
+ * it. Starts are relative to 'from'. */
+void editor_row_draw_spans(EditorModel *model, t_erow *row, int filerow,
+                           int from, int len, struct HlSpans *spans);
+
+/* Decorate chars [col, col+len) of row 'filerow' in a DECOR_GROUP_*
+ * group, redrawing the row. Returns 0, or -1 if out of range. */
+int editor_decorate(EditorModel *model, int group, int filerow, int col,
+                    int len, unsigned char hl);
+
+/* Remove a group's decorations, redrawing the rows they were on. */
+void editor_undecorate(EditorModel *model, int group);
+
+/* The same for its decorations on rows first..last only. */
+void editor_undecorate_rows(EditorModel *model, int group, int first, int last);
+
+/* Add a mark (see marks.h) at (row, col) of the buffer. Returns its id,
+ * or -1 on out of memory. */
+int editor_mark_add(EditorModel *model, int row, int col, int right_gravity);
+
+/* Add a fold (see fold.h) over rows [first, last] of the buffer, clipped
+ * to its end. Returns 0, or -1 if fold_add() refuses it. */
+int editor_fold_add(EditorModel *model, int first, int last, int closed);
+
+/* Release a row's chars, render and hl buffers, wherever they live. */
+void editor_free_row(EditorModel *model, t_erow *row);
+
+/* Free every row and the row arena, leaving the model with no rows.
+ * Arena-owned buffers are released together, without visiting rows. */
+void editor_model_free_rows(EditorModel *model);
+
+/* Document export: consumers walk the rows as (data, len) spans pointing
+ * into the row buffers instead of concatenating them. */
+#define EXPORT_NEWLINES 1   /* Emit a "\n" span after every row */
+
+/* Export callback for one span; return non-zero to stop the walk. */
+typedef int (*editor_span_fn)(const char *data, size_t len, void *arg);
+
+/* Call 'fn' for each span of the document in order (empty rows produce
+ * no chars span). Returns 0, or the non-zero value that stopped the walk. */
+int editor_model_export(const EditorModel *model, int flags,
+                        editor_span_fn fn, void *arg);
+
+/* Number of bytes editor_model_export() produces with the same flags. */
+size_t editor_model_export_size(const EditorModel *model, int flags);
+
+/* The size of a buffer's text, as g Ctrl-G, loki.stats() and the JSON-RPC
+ * status report it. Words are runs of bytes other than blanks. */
+typedef struct EditorCounts {
+    long long bytes;          /* With a newline after every line */
+    long long words;
+    int lines;
+} EditorCounts;
+
+/* The counts of the model's text. The first call counts every row; from
+ * then on each row inserted, changed or deleted adjusts them by what it
+ * adds or takes away, so later calls cost nothing. */
+EditorCounts editor_model_counts(EditorModel *model);
+
+/* Random access for pull-style readers such as tree-sitter's TSInput:
+ * the bytes of 'row' from byte column 'col' to the end of the row, or the
+ * injected newline when 'col' is at the end. Sets *len to 0 past the end
+ * of the document. The result is valid until the row is modified. */
+const char *editor_model_read_at(const EditorModel *model, int row, int col,
+                                 int flags, size_t *len);
+
+/* Split the render columns from coloff that fit in max_cols cells of a
+ * row (see editor_row_cells()) into runs of equal highlight and
+ * selection. *segments is grown as needed (it may start
+ * NULL) and can be reused across calls; *cap is its capacity. Returns the
+ * number of segments; their text points into row->render. Long rows must
+ * have been windowed over the columns with editor_visible_row(). */
+int editor_row_segments(editor_ctx_t *ctx, t_erow *row, int row_idx,
+                        int coloff, int max_cols,
+                        RenderSegment **segments, int *cap);
+
+/* Describe the frame about to be drawn for 'target' from the view state. */
+void view_frame_capture(const editor_ctx_t *ctx, ViewFrame *frame,
+                        const void *target, int rows, int text_cols,
+                        int gutter_width);
+
+/* Position of 'filerow' among the rows of 'prev' if it is undamaged since
+ * then and would be drawn identically in 'now', else -1. */
+int view_frame_reusable_row(const EditorModel *model, const ViewFrame *prev,
+                            const ViewFrame *now, int filerow);
+
+/* Finish drawing 'now': it becomes the previous frame, and the model's
+ * row shifts seen so far are forgotten. */
+void view_frame_commit(EditorModel *model, ViewFrame *prev, ViewFrame *now);
+
+/* Fingerprint of everything the screen shows for 'ctx': equal stamps mean
+ * a redraw would produce the same frame. Used to skip idle frames. */
+uint64_t editor_screen_stamp(const editor_ctx_t *ctx);
+
+/* Row 'filerow' ready for drawing render columns [col, col+cols): it is
+ * rendered, a long row's window is moved to cover them, and the highlight
+ * is fresh. Index render/hl with col - row->render_off. */
+t_erow *editor_visible_row(editor_ctx_t *ctx, int filerow, int col, int cols);
+
+/* What a screen row of text shows: row 'row' from coloff, or with word
+ * wrap on, the part of it from render column 'start' that fills 'len'
+ * cells. */
+typedef struct ScreenLine {
+    int row;
+    int start;              /* -1: not wrapped, shown from coloff */
+    int len;                /* Cells */
+} ScreenLine;
+
+/* The first 'count' screen rows, from rowoff down past the bodies of
+ * closed folds, their rows' highlight brought up to date; rows past the
+ * end are not counted. Sets *n to the lines returned, which stay valid
+ * until the next call, and *wrapped to whether a row among them is
+ * wrapped. */
+const ScreenLine *editor_screen_lines(editor_ctx_t *ctx, int count, int *n,
+                                      int *wrapped);
+
+/* Columns of text beside the gutter, which rows are wrapped at. */
+int editor_text_cols(editor_ctx_t *ctx);
+
+/* Screen row (from the top of the text) and text column of the cursor. */
+int editor_cursor_screen_row(editor_ctx_t *ctx);
+int editor_cursor_screen_col(editor_ctx_t *ctx);
+
+/* The row shown on screen row 'y'. *start, when not NULL, is set to the
+ * render column that screen row starts at, or -1 if the row is not
+ * wrapped. */
+int editor_screen_row_to_row(editor_ctx_t *ctx, int y, int *start);
+
+/* Render column of chars[cx] in 'row', TABs expanded. */
+int editor_row_cx_to_rx(t_erow *row, int cx);
+
+/* Cells on screen of render columns [from, to) of a row (see utf8.h):
+ * render columns are bytes of the render, a UTF-8 character taking its
+ * East Asian width. O(1) amortized through per-row checkpoints. A long
+ * row only counts the columns in its window. */
+int editor_row_cells(EditorModel *model, t_erow *row, int from, int to);
+
+/* Index of the char drawn 'cells' cells right of render column 'rx' (the
+ * row's end if none is). */
+int editor_row_cell_to_cx(t_erow *row, int rx, int cells);
+
+/* Width of the line number gutter, separator included; 0 when line
+ * numbers are off or the buffer is empty. Cached in the view until the
+ * line count gains or loses a digit. */
+int editor_gutter_width(editor_ctx_t *ctx);
+
+/* Status line numbers: the file line the cursor is on and the lines of
+ * the file, 1-based; 0 where a large file's index does not tell yet (see
+ * lazy.h). */
+void editor_status_lines(editor_ctx_t *ctx, int *current, int *total);
+
+/* Status line label of the file's language, e.g. "LUA ", or "" when the
+ * file has no language or it is not initialized. The lookup is cached in
+ * the view until the filename or the set of languages changes. */
+const char *editor_lang_label(editor_ctx_t *ctx);
 
 /* Screen rendering */
 void editor_refresh_screen(editor_ctx_t *ctx);
@@ -336,6 +949,12 @@ void lua_repl_free(t_lua_repl *repl);
 LuaHost *lua_host_create(void);
 void lua_host_free(LuaHost *host);
 void lua_host_init_repl(LuaHost *host);
+void lua_highlight_cache_free(LuaHost *host);
+/* Row hook running the Lua highlight hook (see syntax_set_row_hook()) */
+void lua_highlight_rows(editor_ctx_t *ctx, int first, int last);
+/* Miss hook (see syntax_set_miss_hook()) running the loader a language
+ * was declared with by loki.declare_language() */
+int lua_declared_language_load(const char *filename);
 void lua_repl_handle_keypress(editor_ctx_t *ctx, int key);
 void lua_repl_render(editor_ctx_t *ctx, struct abuf *ab);
 void lua_repl_append_log(editor_ctx_t *ctx, const char *line);
@@ -354,6 +973,13 @@ void editor_process_keypress(editor_ctx_t *ctx, int fd);
 /* Cursor movement */
 void editor_move_cursor(editor_ctx_t *ctx, int key);
 
+/* Move the cursor as 'count' presses of arrow 'key' would, stopping where
+ * one would no longer move it, but in one go: up and down go straight to
+ * the row, left and right step over the characters between (a line break
+ * counts as one) without scrolling on the way. With closed folds the
+ * steps are taken one by one. */
+void editor_move_cursor_count(editor_ctx_t *ctx, int key, int count);
+
 /* Modal editing - event-based entry point
  * Process an EditorEvent through the modal system.
  * Preferred for testing and non-terminal input sources.
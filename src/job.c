@@ -0,0 +1,370 @@
+/* job.c - Background jobs: commands run with their output streamed back
+ *
+ * See job.h for an overview. A job is in the slot of its id until its
+ * exit has been handled, and freed once its handles are closed too. The
+ * exit is the last event of a job, so an id only names another job once
+ * no event of the one before is left in the queue.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "job.h"
+#include "buffers.h"
+#include "follow.h"
+
+/* Output read into a payload of the queue: 'len' bytes, then a NUL */
+typedef struct JobChunk {
+    size_t len;
+    char data[];
+} JobChunk;
+
+typedef struct JobStream {
+    uv_pipe_t pipe;         /* Its data is the Job */
+    JobChunk *chunk;        /* Read and not yet queued, or NULL */
+    int eof;
+} JobStream;
+
+typedef struct Job {
+    int id;
+    uv_process_t proc;      /* Its data is the Job */
+    JobStream out[2];       /* By JOB_EVENT_STDOUT, JOB_EVENT_STDERR */
+    int open;               /* Handles not closed yet */
+    int exited;
+    int64_t status;
+    int term_signal;
+    int exit_queued;
+    int exit_handled;       /* Out of its slot: freed as the handles close */
+    int paused;             /* Its pipes are not being read */
+    size_t queued;          /* Bytes in events not handled yet */
+    int dirty;              /* On the dirty list */
+    struct Job *next_dirty;
+    int buffer_id;
+    int partial;            /* The buffer's last row is a line not ended */
+    JobOutputFn on_output;
+    JobExitFn on_exit;
+    void *opaque;
+} Job;
+
+static Job **slots;         /* By id - 1 */
+static int nslots;
+static int njobs;
+static Job *dirty_jobs;     /* Output read since the last tick */
+
+static void job_event_handler(AsyncEvent *event, void *data);
+
+static Job *job_get(int id) {
+    return id >= 1 && id <= nslots ? slots[id - 1] : NULL;
+}
+
+static void on_close(uv_handle_t *handle) {
+    Job *job = handle->data;
+    if (--job->open == 0 && job->exit_handled) free(job);
+}
+
+static void close_handle(uv_handle_t *handle) {
+    if (!uv_is_closing(handle)) uv_close(handle, on_close);
+}
+
+/* Let job_tick() see to the job */
+static void mark_dirty(Job *job) {
+    if (job->dirty) return;
+    job->dirty = 1;
+    job->next_dirty = dirty_jobs;
+    dirty_jobs = job;
+}
+
+/* ============================== The events ============================== */
+
+/* Queue an event of 'kind' for the job, with its chunk. Returns 0, or -1
+ * if the queue is full. */
+static int push(Job *job, int kind, JobChunk *chunk) {
+    if (async_queue_get_handler(NULL, JOB_ASYNC_EVENT) != job_event_handler) {
+        async_queue_set_handler(NULL, JOB_ASYNC_EVENT, job_event_handler);
+        async_event_set_type_name(JOB_ASYNC_EVENT, "job");
+    }
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = JOB_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+    ev.data.user.i64[1] = kind;
+    if (chunk) {
+        ev.flags = ASYNC_FLAG_PAYLOAD;
+        ev.heap_data = chunk;
+    }
+    return async_queue_push(NULL, &ev) == 0 ? 0 : -1;
+}
+
+/* Queue the output read, and the exit once it is all read. Returns 0, or
+ * -1 if the queue is full with some left. */
+static int flush(Job *job) {
+    for (int s = 0; s < 2; s++) {
+        JobChunk *chunk = job->out[s].chunk;
+        if (chunk == NULL || chunk->len == 0) continue;
+        /* A little output, as of a line a frame, goes in a payload its
+         * size: a job that has gone quiet holds no chunk */
+        JobChunk *event = chunk;
+        if (chunk->len < JOB_CHUNK_MAX / 4) {
+            event = async_payload_alloc(sizeof(JobChunk) + chunk->len + 1);
+            if (event == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+            event->len = chunk->len;
+            memcpy(event->data, chunk->data, chunk->len);
+        }
+        event->data[event->len] = '\0';
+        if (push(job, s, event) == -1) {
+            if (event != chunk) async_payload_release(event);
+            return -1;
+        }
+        job->queued += event->len;
+        if (event != chunk) async_payload_release(chunk);
+        job->out[s].chunk = NULL;
+    }
+    if (job->exited && job->out[0].eof && job->out[1].eof && !job->exit_queued) {
+        if (push(job, JOB_EVENT_EXIT, NULL) == -1) return -1;
+        job->exit_queued = 1;
+    }
+    return 0;
+}
+
+/* ============================ The command =============================== */
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void pause_reading(Job *job) {
+    for (int s = 0; s < 2; s++)
+        if (!job->out[s].eof) uv_read_stop((uv_stream_t *)&job->out[s].pipe);
+    job->paused = 1;
+}
+
+static void resume_reading(Job *job) {
+    for (int s = 0; s < 2; s++)
+        if (!job->out[s].eof)
+            uv_read_start((uv_stream_t *)&job->out[s].pipe, on_alloc, on_read);
+    job->paused = 0;
+}
+
+/* Is there room to read into, and not too much output queued? */
+static int may_read(const Job *job) {
+    for (int s = 0; s < 2; s++)
+        if (job->out[s].chunk && job->out[s].chunk->len == JOB_CHUNK_MAX) return 0;
+    return job->queued < JOB_QUEUED_MAX / 2;
+}
+
+static JobStream *stream_of(Job *job, uv_handle_t *handle) {
+    return handle == (uv_handle_t *)&job->out[0].pipe ? &job->out[0] : &job->out[1];
+}
+
+/* Read into the stream's chunk. on_read() queues a full one or stops
+ * reading, so there is always room. */
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    (void)suggested;
+    Job *job = handle->data;
+    JobStream *s = stream_of(job, handle);
+    if (s->chunk == NULL) {
+        s->chunk = async_payload_alloc(sizeof(JobChunk) + JOB_CHUNK_MAX + 1);
+        if (s->chunk == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        s->chunk->len = 0;
+    }
+    *buf = uv_buf_init(s->chunk->data + s->chunk->len,
+                       (unsigned int)(JOB_CHUNK_MAX - s->chunk->len));
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    (void)buf;
+    Job *job = stream->data;
+    JobStream *s = stream_of(job, (uv_handle_t *)stream);
+    if (nread == 0) return;
+    if (nread == UV_ENOBUFS) {      /* Not expected: wait for the next tick */
+        pause_reading(job);
+    } else if (nread > 0) {
+        s->chunk->len += (size_t)nread;
+        if (s->chunk->len == JOB_CHUNK_MAX && flush(job) == -1) pause_reading(job);
+        else if (job->queued >= JOB_QUEUED_MAX) pause_reading(job);
+    } else {
+        /* EOF, or an error taken as one */
+        s->eof = 1;
+        close_handle((uv_handle_t *)stream);
+    }
+    mark_dirty(job);
+}
+
+static void on_proc_exit(uv_process_t *proc, int64_t status, int term_signal) {
+    Job *job = proc->data;
+    job->exited = 1;
+    job->status = status;
+    job->term_signal = term_signal;
+    close_handle((uv_handle_t *)proc);
+    mark_dirty(job);
+}
+
+/* ============================== Delivery ================================ */
+
+/* Add output to the job's buffer, if it has one and it takes edits */
+static void to_buffer(Job *job, char *data, size_t len) {
+    editor_ctx_t *buf = job->buffer_id >= 0 ? buffer_get(job->buffer_id) : NULL;
+    if (buf == NULL || len == 0 || editor_refuse_edit(buf)) return;
+    int clean = buf->model.dirty == 0;
+    follow_append(buf, data, len, &job->partial);
+    if (clean) buf->model.dirty = 0;     /* Output, not edits to save */
+}
+
+/* Give up the slot of a job whose exit has been handled */
+static void release(Job *job) {
+    for (int s = 0; s < 2; s++) {
+        if (job->out[s].chunk) async_payload_release(job->out[s].chunk);
+        job->out[s].chunk = NULL;
+    }
+    slots[job->id - 1] = NULL;
+    njobs--;
+    job->exit_handled = 1;
+    if (job->open == 0) free(job);
+}
+
+/* JOB_ASYNC_EVENT handler: hand a chunk of output, or the exit, to the
+ * job's buffer and functions */
+static void job_event_handler(AsyncEvent *event, void *data) {
+    editor_ctx_t *ctx = data;
+    int id = (int)event->data.user.i64[0];
+    int kind = (int)event->data.user.i64[1];
+    Job *job = job_get(id);
+    if (job == NULL) return;
+
+    if (kind != JOB_EVENT_EXIT) {
+        JobChunk *chunk = event->heap_data;
+        job->queued -= chunk->len;
+        to_buffer(job, chunk->data, chunk->len);
+        if (job->on_output)
+            job->on_output(ctx, id, kind, chunk->data, chunk->len, job->opaque);
+        if (job->paused && may_read(job)) resume_reading(job);
+        return;
+    }
+
+    editor_ctx_t *buf = job->buffer_id >= 0 ? buffer_get(job->buffer_id) : NULL;
+    if (buf && job->term_signal)
+        editor_set_status_msg(buf, "Job %d killed by signal %d", id, job->term_signal);
+    else if (buf)
+        editor_set_status_msg(buf, "Job %d done: exit %d", id, (int)job->status);
+    if (job->on_exit) job->on_exit(ctx, id, job->status, job->term_signal, job->opaque);
+    release(job);
+}
+
+/* ================================= API ================================== */
+
+int job_start(const JobSpec *spec, const char **error) {
+    if (async_queue_global() == NULL) {
+        *error = "no event queue";
+        return -1;
+    }
+    /* A command that quits reading is an EPIPE, not the end of the editor */
+    signal(SIGPIPE, SIG_IGN);
+
+    int slot = 0;
+    while (slot < nslots && slots[slot]) slot++;
+    if (slot == nslots) {
+        int cap = nslots ? nslots * 2 : 16;
+        Job **grown = realloc(slots, sizeof(Job *) * (size_t)cap);
+        if (grown == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        memset(grown + nslots, 0, sizeof(Job *) * (size_t)(cap - nslots));
+        slots = grown;
+        nslots = cap;
+    }
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    job->id = slot + 1;
+    job->buffer_id = spec->buffer_id;
+    job->on_output = spec->on_output;
+    job->on_exit = spec->on_exit;
+    job->opaque = spec->opaque;
+
+    uv_loop_t *loop = uv_default_loop();
+    for (int s = 0; s < 2; s++) {
+        uv_pipe_init(loop, &job->out[s].pipe, 0);
+        job->out[s].pipe.data = job;
+    }
+    job->proc.data = job;
+    job->open = 3;
+
+    char *args[] = { "sh", "-c", (char *)spec->cmd, NULL };
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_IGNORE;
+    stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[1].data.stream = (uv_stream_t *)&job->out[0].pipe;
+    stdio[2].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[2].data.stream = (uv_stream_t *)&job->out[1].pipe;
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.file = "/bin/sh";
+    options.args = args;
+    options.cwd = spec->cwd;
+    options.exit_cb = on_proc_exit;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+    int rc = uv_spawn(loop, &job->proc, &options);
+    if (rc != 0) {
+        *error = uv_strerror(rc);
+        job->exit_handled = 1;      /* Freed as the handles close */
+        close_handle((uv_handle_t *)&job->out[0].pipe);
+        close_handle((uv_handle_t *)&job->out[1].pipe);
+        close_handle((uv_handle_t *)&job->proc);
+        return -1;
+    }
+    resume_reading(job);
+    slots[slot] = job;
+    njobs++;
+    return job->id;
+}
+
+int job_stop(int id) {
+    Job *job = job_get(id);
+    if (job == NULL || job->exited) return -1;
+    uv_process_kill(&job->proc, SIGTERM);
+    return 0;
+}
+
+int job_count(void) {
+    return njobs;
+}
+
+int job_tick(void) {
+    Job *job = dirty_jobs;
+    dirty_jobs = NULL;
+    while (job) {
+        Job *next = job->next_dirty;
+        job->dirty = 0;
+        if (flush(job) == -1) mark_dirty(job);      /* Again next tick */
+        else if (job->paused && may_read(job)) resume_reading(job);
+        job = next;
+    }
+    return dirty_jobs ? 0 : -1;
+}
+
+void job_stop_all(void) {
+    for (int i = 0; i < nslots; i++) {
+        Job *job = slots[i];
+        if (job == NULL) continue;
+        if (!job->exited) uv_process_kill(&job->proc, SIGTERM);
+        for (int s = 0; s < 2; s++) close_handle((uv_handle_t *)&job->out[s].pipe);
+        close_handle((uv_handle_t *)&job->proc);
+        release(job);
+    }
+    free(slots);
+    slots = NULL;
+    nslots = 0;
+    dirty_jobs = NULL;
+}
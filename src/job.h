@@ -0,0 +1,84 @@
+/* job.h - Background jobs: commands run with their output streamed back
+ *
+ * job_start() runs a command with `sh -c` (uv_spawn()) on the loop
+ * event_loop_wait() sleeps in, its stdin /dev/null, and reads its stdout
+ * and stderr as they come. Output is read straight into a payload of the
+ * async queue (async_payload_alloc()), one per stream, and handed over
+ * without a copy as a JOB_ASYNC_EVENT once it holds JOB_CHUNK_MAX bytes
+ * or job_tick(), run by the main loop, finds it waiting: a command that
+ * writes a line at a time still costs an event per frame, not per line.
+ *
+ * Each chunk goes to the job's output function, and to a buffer if it was
+ * given one: its lines are added with one editor_append_lines() and the
+ * view kept to the end as a followed file's is (see follow_append()). The
+ * exit comes after the last chunk.
+ *
+ * A job that is not writing costs nothing: its pipes wait in the loop,
+ * and job_tick() only looks at jobs with output read since it last ran.
+ * When the queue is full, or JOB_QUEUED_MAX bytes of a job's output wait
+ * in it, reading its pipes stops until the events are handled, so the
+ * command waits on its writes and nothing is dropped.
+ */
+
+#ifndef LOKI_JOB_H
+#define LOKI_JOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "internal.h"
+#include "async_queue.h"
+
+/* Async event carrying a job's output or exit (data.user.i64[0] = job
+ * id, i64[1] = JOB_EVENT_*) */
+#define JOB_ASYNC_EVENT (ASYNC_EVENT_USER + 8)
+
+#define JOB_EVENT_STDOUT 0
+#define JOB_EVENT_STDERR 1
+#define JOB_EVENT_EXIT 2
+
+/* Bytes of a stream per event, at most */
+#define JOB_CHUNK_MAX ((size_t)64 << 10)
+
+/* Bytes of a job's output queued and not yet handled before its pipes
+ * stop being read */
+#define JOB_QUEUED_MAX ((size_t)4 << 20)
+
+/* Output of a job: 'stream' is JOB_EVENT_STDOUT or JOB_EVENT_STDERR, and
+ * 'data' is 'len' bytes, NUL-terminated, valid for the call. 'ctx' is
+ * the buffer the event is dispatched to. */
+typedef void (*JobOutputFn)(editor_ctx_t *ctx, int id, int stream,
+                            const char *data, size_t len, void *opaque);
+
+/* The exit of a job, after its last output: its exit status, or the
+ * signal that ended it (0 if none) */
+typedef void (*JobExitFn)(editor_ctx_t *ctx, int id, int64_t status,
+                          int term_signal, void *opaque);
+
+typedef struct JobSpec {
+    const char *cmd;        /* Run with sh -c */
+    const char *cwd;        /* Or NULL: the editor's */
+    int buffer_id;          /* Buffer the output is added to, or -1 */
+    JobOutputFn on_output;  /* Or NULL */
+    JobExitFn on_exit;      /* Or NULL */
+    void *opaque;
+} JobSpec;
+
+/* Start a job. Returns its id (> 0), or -1 with the reason in *error. */
+int job_start(const JobSpec *spec, const char **error);
+
+/* Send a job's command SIGTERM. Its exit comes as for any other. Returns
+ * 0, or -1 if there is no such job running. */
+int job_stop(int id);
+
+/* Jobs started whose exit has not been handled */
+int job_count(void);
+
+/* Hand the output read since the last tick to the queue. Returns 0 if
+ * some is still waiting (the queue is full), -1 if none is. */
+int job_tick(void);
+
+/* Kill all jobs and forget them, as the editor exits: no more of their
+ * events are delivered. */
+void job_stop_all(void);
+
+#endif /* LOKI_JOB_H */
@@ -1,38 +1,98 @@
 /* json.c - Minimal JSON implementation for editor RPC
  *
  * Simple JSON serializer and parser for the JSON-RPC harness.
+ *
+ * The builder copies the runs of a string that need no escape whole,
+ * finding the next quote, backslash or control character 16 bytes at a
+ * time with SSE2 (8 with word-at-a-time compares otherwise), and writes
+ * integers two digits at a time. json_builder_reserve() makes room for a
+ * whole document up front.
+ *
+ * A parse allocates from one arena, in blocks that double from about the
+ * size of the text, and frees it in one call. Members of an array or
+ * object gather on a scratch stack while it is open and are copied to
+ * the arena once, at their final count, so nothing is reallocated in it.
+ *
+ * MessagePack goes through the same builder calls and into the same
+ * values. Its maps and arrays give their counts first: the builder
+ * leaves room for a 32-bit count and, once known, puts it in as few
+ * bytes as it needs; the parser allocates each at its count directly.
  */
 
 #include "json.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+
+#if defined(__GNUC__) && !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_USE_SSE2 1
+#endif
 
 /* ======================= JSON Builder ====================================== */
 
 #define INITIAL_CAP 1024
 
 void json_builder_init(JsonBuilder *jb) {
-    jb->buf = malloc(INITIAL_CAP);
+    jb->buf = NULL;     /* Allocated by the first append, or a reserve */
     jb->len = 0;
-    jb->cap = INITIAL_CAP;
-    jb->error = (jb->buf == NULL);
+    jb->cap = 0;
+    jb->error = 0;
     jb->depth = 0;
     jb->need_comma = 0;
+    jb->msgpack = 0;
+    jb->refs = NULL;
+    jb->ref_count = 0;
+    jb->ref_cap = 0;
     if (jb->buf) jb->buf[0] = '\0';
 }
 
+void json_builder_init_msgpack(JsonBuilder *jb) {
+    json_builder_init(jb);
+    jb->msgpack = 1;
+}
+
 void json_builder_free(JsonBuilder *jb) {
     free(jb->buf);
+    free(jb->refs);
     jb->buf = NULL;
     jb->len = 0;
     jb->cap = 0;
+    jb->refs = NULL;
+    jb->ref_count = 0;
+    jb->ref_cap = 0;
 }
 
 const char *json_builder_get(JsonBuilder *jb) {
-    if (jb->error) return "{}";
-    return jb->buf;
+    if (jb->error) return jb->msgpack ? "" : "{}";
+    return jb->buf ? jb->buf : "";
+}
+
+void json_builder_reserve(JsonBuilder *jb, size_t extra) {
+    if (jb->error || jb->len + extra + 1 <= jb->cap) return;
+    size_t cap = jb->len + extra + 1;
+    if (cap < INITIAL_CAP) cap = INITIAL_CAP;
+    char *buf = realloc(jb->buf, cap);
+    if (!buf) {
+        jb->error = 1;
+        return;
+    }
+    if (!jb->buf) buf[0] = '\0';
+    jb->buf = buf;
+    jb->cap = cap;
+}
+
+char *json_builder_take(JsonBuilder *jb) {
+    if (jb->error) return NULL;
+    json_builder_reserve(jb, 0);
+    char *buf = jb->buf;
+    jb->buf = NULL;
+    jb->len = 0;
+    jb->cap = 0;
+    return buf;
 }
 
 void json_builder_reset(JsonBuilder *jb) {
@@ -40,24 +100,77 @@ void json_builder_reset(JsonBuilder *jb) {
     jb->error = 0;
     jb->depth = 0;
     jb->need_comma = 0;
+    jb->ref_count = 0;
     if (jb->buf) jb->buf[0] = '\0';
 }
 
-static void json_append(JsonBuilder *jb, const char *s, size_t len) {
-    if (jb->error) return;
+size_t json_builder_size(const JsonBuilder *jb) {
+    size_t size = jb->len;
+    for (size_t i = 0; i < jb->ref_count; i++) size += jb->refs[i].len;
+    return size;
+}
 
-    while (jb->len + len + 1 > jb->cap) {
-        size_t new_cap = jb->cap * 2;
-        char *new_buf = realloc(jb->buf, new_cap);
-        if (!new_buf) {
-            jb->error = 1;
-            return;
+int json_builder_iov(const JsonBuilder *jb, struct iovec *iov, int max) {
+    int n = 0;
+    size_t at = 0;
+    for (size_t i = 0; i <= jb->ref_count; i++) {
+        size_t end = i < jb->ref_count ? jb->refs[i].at : jb->len;
+        if (end > at) {
+            if (n < max) {
+                iov[n].iov_base = jb->buf + at;
+                iov[n].iov_len = end - at;
+            }
+            n++;
+        }
+        at = end;
+        if (i < jb->ref_count) {
+            if (n < max) {
+                iov[n].iov_base = (void *)jb->refs[i].text;
+                iov[n].iov_len = jb->refs[i].len;
+            }
+            n++;
         }
-        jb->buf = new_buf;
-        jb->cap = new_cap;
     }
+    return n;
+}
+
+char *json_builder_flatten(const JsonBuilder *jb, size_t *len) {
+    if (jb->error) return NULL;
+    size_t size = json_builder_size(jb);
+    char *out = malloc(size ? size : 1);
+    if (!out) return NULL;
+    size_t at = 0, pos = 0;
+    for (size_t i = 0; i <= jb->ref_count; i++) {
+        size_t end = i < jb->ref_count ? jb->refs[i].at : jb->len;
+        if (end > at) memcpy(out + pos, jb->buf + at, end - at);
+        pos += end - at;
+        at = end;
+        if (i < jb->ref_count) {
+            memcpy(out + pos, jb->refs[i].text, jb->refs[i].len);
+            pos += jb->refs[i].len;
+        }
+    }
+    if (len) *len = size;
+    return out;
+}
+
+/* Room for 'len' more bytes (and the terminator) at buf + len, or NULL
+ * with the error set */
+static char *json_room(JsonBuilder *jb, size_t len) {
+    if (jb->error) return NULL;
+    if (jb->len + len + 1 > jb->cap) {
+        size_t new_cap = jb->cap ? jb->cap * 2 : INITIAL_CAP;
+        while (jb->len + len + 1 > new_cap) new_cap *= 2;
+        json_builder_reserve(jb, new_cap - jb->len - 1);
+        if (jb->error) return NULL;
+    }
+    return jb->buf + jb->len;
+}
 
-    memcpy(jb->buf + jb->len, s, len);
+static void json_append(JsonBuilder *jb, const char *s, size_t len) {
+    char *p = json_room(jb, len);
+    if (!p) return;
+    memcpy(p, s, len);
     jb->len += len;
     jb->buf[jb->len] = '\0';
 }
@@ -66,76 +179,316 @@ static void json_append_str(JsonBuilder *jb, const char *s) {
     json_append(jb, s, strlen(s));
 }
 
+/* One byte: the punctuation between everything else */
+static void json_putc(JsonBuilder *jb, char c) {
+    if (jb->len + 2 > jb->cap) {
+        json_append(jb, &c, 1);
+        return;
+    }
+    jb->buf[jb->len++] = c;
+    jb->buf[jb->len] = '\0';
+}
+
 static void json_maybe_comma(JsonBuilder *jb) {
     if (jb->need_comma) {
-        json_append_str(jb, ",");
+        json_putc(jb, ',');
     }
     jb->need_comma = 0;
 }
 
+/* ======================= MessagePack Writing =============================== */
+
+/* A tag byte followed by 'size' bytes of 'v', big-endian */
+static void mp_tagged(JsonBuilder *jb, unsigned char tag, uint64_t v, int size) {
+    unsigned char b[9];
+    b[0] = tag;
+    for (int i = 0; i < size; i++) b[1 + i] = (unsigned char)(v >> (8 * (size - 1 - i)));
+    json_append(jb, (const char *)b, (size_t)size + 1);
+}
+
+/* A value starts: an item of the array it is in */
+static void mp_item(JsonBuilder *jb) {
+    if (jb->depth > 0 && jb->open[jb->depth - 1].is_array) jb->open[jb->depth - 1].count++;
+}
+
+static void mp_start(JsonBuilder *jb, int is_array) {
+    mp_item(jb);
+    if (jb->depth >= JSON_BUILDER_MAX_DEPTH) {
+        jb->error = 1;
+        return;
+    }
+    JsonBuilderOpen *o = &jb->open[jb->depth++];
+    o->at = jb->len;
+    o->count = 0;
+    o->is_array = is_array;
+    o->refs = jb->ref_count;
+    mp_tagged(jb, is_array ? 0xdd : 0xdf, 0, 4);
+}
+
+/* Fill in the count of the newest open map or array, in as few bytes
+ * as it takes unless strings after it are kept by reference (their
+ * offsets would move) */
+static void mp_end(JsonBuilder *jb) {
+    if (jb->depth <= 0 || jb->error) return;
+    JsonBuilderOpen *o = &jb->open[--jb->depth];
+    unsigned char *h = (unsigned char *)jb->buf + o->at;
+    uint32_t n = o->count;
+    size_t header = 5;
+    if (jb->ref_count == o->refs) {
+        if (n < 16) {
+            h[0] = (unsigned char)((o->is_array ? 0x90 : 0x80) | n);
+            header = 1;
+        } else if (n < 65536) {
+            h[0] = o->is_array ? 0xdc : 0xde;
+            h[1] = (unsigned char)(n >> 8);
+            h[2] = (unsigned char)n;
+            header = 3;
+        }
+    }
+    if (header == 5) {
+        for (int i = 0; i < 4; i++) h[1 + i] = (unsigned char)(n >> (8 * (3 - i)));
+        return;
+    }
+    size_t body = jb->len - o->at - 5;
+    memmove(h + header, h + 5, body);
+    jb->len -= 5 - header;
+    jb->buf[jb->len] = '\0';
+}
+
+static void mp_str(JsonBuilder *jb, const char *s, size_t len) {
+    if (len < 32) {
+        unsigned char tag = (unsigned char)(0xa0 | len);
+        json_append(jb, (const char *)&tag, 1);
+    } else if (len < 256) {
+        mp_tagged(jb, 0xd9, len, 1);
+    } else if (len < 65536) {
+        mp_tagged(jb, 0xda, len, 2);
+    } else {
+        mp_tagged(jb, 0xdb, len, 4);
+    }
+    if (s) json_append(jb, s, len);
+}
+
+static void mp_int(JsonBuilder *jb, long long v) {
+    if (v >= 0 && v < 128) {
+        unsigned char b = (unsigned char)v;
+        json_append(jb, (const char *)&b, 1);
+    } else if (v < 0 && v >= -32) {
+        unsigned char b = (unsigned char)(0xe0 | (v + 32));
+        json_append(jb, (const char *)&b, 1);
+    } else if (v >= -128 && v < 128) {
+        mp_tagged(jb, 0xd0, (uint64_t)v, 1);
+    } else if (v >= -32768 && v < 32768) {
+        mp_tagged(jb, 0xd1, (uint64_t)v, 2);
+    } else {
+        mp_tagged(jb, 0xd2, (uint64_t)v, 4);
+    }
+}
+
+/* ======================= JSON Writing ====================================== */
+
 void json_object_start(JsonBuilder *jb) {
+    if (jb->msgpack) {
+        mp_start(jb, 0);
+        return;
+    }
     json_maybe_comma(jb);
-    json_append_str(jb, "{");
+    json_putc(jb, '{');
     jb->depth++;
     jb->need_comma = 0;
 }
 
 void json_object_end(JsonBuilder *jb) {
+    if (jb->msgpack) {
+        mp_end(jb);
+        return;
+    }
     jb->depth--;
-    json_append_str(jb, "}");
+    json_putc(jb, '}');
     jb->need_comma = 1;
 }
 
 void json_array_start(JsonBuilder *jb) {
+    if (jb->msgpack) {
+        mp_start(jb, 1);
+        return;
+    }
     json_maybe_comma(jb);
-    json_append_str(jb, "[");
+    json_putc(jb, '[');
     jb->depth++;
     jb->need_comma = 0;
 }
 
 void json_array_end(JsonBuilder *jb) {
+    if (jb->msgpack) {
+        mp_end(jb);
+        return;
+    }
     jb->depth--;
-    json_append_str(jb, "]");
+    json_putc(jb, ']');
     jb->need_comma = 1;
 }
 
 void json_key(JsonBuilder *jb, const char *key) {
-    json_maybe_comma(jb);
-    json_append_str(jb, "\"");
-    json_append_str(jb, key);
-    json_append_str(jb, "\":");
+    if (jb->msgpack) {
+        if (jb->depth > 0) jb->open[jb->depth - 1].count++;
+        mp_str(jb, key, strlen(key));
+        return;
+    }
+    /* Comma, quotes, key and colon in one go */
+    size_t len = strlen(key);
+    char *p = json_room(jb, len + 4);
+    if (!p) return;
+    if (jb->need_comma) *p++ = ',';
+    *p++ = '"';
+    memcpy(p, key, len);
+    p += len;
+    *p++ = '"';
+    *p++ = ':';
+    *p = '\0';
+    jb->len = (size_t)(p - jb->buf);
+    jb->need_comma = 0;
+}
+
+#ifndef JSON_USE_SSE2
+static uint64_t load_word(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+/* Bit 7 set in each byte of 'w' that is zero */
+static uint64_t zero_bytes(uint64_t w) {
+    const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((w & low) + low) | w | low);
+}
+
+#if defined(__GNUC__)
+#define word_first(m) ((size_t)__builtin_ctzll(m) / 8)
+#else
+static size_t word_first(uint64_t m) {
+    size_t n = 0;
+    while (!(m & 0x80)) { m >>= 8; n++; }
+    return n;
+}
+#endif
+#endif
+
+static int needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
 }
 
-/* Escape special characters in string */
+/* Offset of the first byte in [i, len) that must be escaped, or len */
+static size_t find_escape(const char *s, size_t i, size_t len) {
+#ifdef JSON_USE_SSE2
+    const __m128i quote = _mm_set1_epi8('"'), slash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                _mm_cmpeq_epi8(v, slash)),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+        int m = _mm_movemask_epi8(hit);
+        if (m) return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#else
+    /* Bytes below 0x20: the borrow of the subtraction only marks bytes
+     * after the first such one, so the first mark is exact */
+    const uint64_t ones = 0x0101010101010101ULL, highs = ones * 0x80;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = load_word(s + i);
+        uint64_t m = zero_bytes(w ^ (ones * '"')) | zero_bytes(w ^ (ones * '\\')) |
+                     ((w - ones * 0x20) & ~w & highs);
+        if (m) return i + word_first(m);
+    }
+#endif
+    while (i < len && !needs_escape((unsigned char)s[i])) i++;
+    return i;
+}
+
+/* Write 'value' in decimal, two digits at a time from the end */
+static void json_append_int(JsonBuilder *jb, int value) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char buf[16], *end = buf + sizeof(buf), *p = end;
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    while (v >= 100) {
+        unsigned int pair = (v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        p[0] = pairs[pair];
+        p[1] = pairs[pair + 1];
+    }
+    if (v >= 10) {
+        p -= 2;
+        p[0] = pairs[v * 2];
+        p[1] = pairs[v * 2 + 1];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    if (value < 0) *--p = '-';
+    json_append(jb, p, (size_t)(end - p));
+}
+
+/* Escape special characters in string. Runs without any are copied
+ * whole, found a block at a time. */
 static void json_escape_string(JsonBuilder *jb, const char *s, size_t len) {
-    json_append_str(jb, "\"");
+    static const char hex[] = "0123456789abcdef";
+    char *p = json_room(jb, len + 2);
+    if (!p) return;
+    *p = '"';
+    jb->len++;
+
+    size_t i = 0;
+    while (i < len) {
+        size_t end = find_escape(s, i, len);
+        if (end > i) {
+            /* Room for the rest unescaped was made before */
+            memcpy(jb->buf + jb->len, s + i, end - i);
+            jb->len += end - i;
+            i = end;
+            if (i == len) break;
+        }
 
-    for (size_t i = 0; i < len; i++) {
-        unsigned char c = (unsigned char)s[i];
+        unsigned char c = (unsigned char)s[i++];
+        char esc[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t n = 2;
         switch (c) {
-            case '"':  json_append_str(jb, "\\\""); break;
-            case '\\': json_append_str(jb, "\\\\"); break;
-            case '\b': json_append_str(jb, "\\b"); break;
-            case '\f': json_append_str(jb, "\\f"); break;
-            case '\n': json_append_str(jb, "\\n"); break;
-            case '\r': json_append_str(jb, "\\r"); break;
-            case '\t': json_append_str(jb, "\\t"); break;
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
             default:
-                if (c < 32) {
-                    char buf[8];
-                    snprintf(buf, sizeof(buf), "\\u%04x", c);
-                    json_append_str(jb, buf);
-                } else {
-                    json_append(jb, (const char *)&c, 1);
-                }
+                esc[1] = 'u';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 15];
+                n = 6;
                 break;
         }
+        /* The escape, and room again for what is left and the quote */
+        p = json_room(jb, n + (len - i) + 1);
+        if (!p) return;
+        memcpy(p, esc, n);
+        jb->len += n;
     }
 
-    json_append_str(jb, "\"");
+    jb->buf[jb->len++] = '"';
+    jb->buf[jb->len] = '\0';
 }
 
 void json_string(JsonBuilder *jb, const char *value) {
+    if (jb->msgpack) {
+        json_string_ref(jb, value, value ? strlen(value) : 0);
+        return;
+    }
     json_maybe_comma(jb);
     if (value) {
         json_escape_string(jb, value, strlen(value));
@@ -146,6 +499,14 @@ void json_string(JsonBuilder *jb, const char *value) {
 }
 
 void json_string_len(JsonBuilder *jb, const char *value, size_t len) {
+    if (jb->msgpack) {
+        mp_item(jb);
+        if (value)
+            mp_str(jb, value, len);
+        else
+            json_append(jb, "\xc0", 1);
+        return;
+    }
     json_maybe_comma(jb);
     if (value) {
         json_escape_string(jb, value, len);
@@ -155,21 +516,75 @@ void json_string_len(JsonBuilder *jb, const char *value, size_t len) {
     jb->need_comma = 1;
 }
 
+void json_string_ref(JsonBuilder *jb, const char *value, size_t len) {
+    if (!jb->msgpack || !value || len < JSON_REF_MIN) {
+        json_string_len(jb, value, len);
+        return;
+    }
+    mp_item(jb);
+    mp_str(jb, NULL, len);
+    if (jb->error) return;
+    if (jb->ref_count == jb->ref_cap) {
+        size_t cap = jb->ref_cap ? jb->ref_cap * 2 : 64;
+        JsonBuilderRef *refs = realloc(jb->refs, cap * sizeof(*refs));
+        if (!refs) {
+            jb->error = 1;
+            return;
+        }
+        jb->refs = refs;
+        jb->ref_cap = cap;
+    }
+    JsonBuilderRef *ref = &jb->refs[jb->ref_count++];
+    ref->at = jb->len;
+    ref->text = value;
+    ref->len = len;
+}
+
 void json_int(JsonBuilder *jb, int value) {
+    if (jb->msgpack) {
+        mp_item(jb);
+        mp_int(jb, value);
+        return;
+    }
     json_maybe_comma(jb);
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%d", value);
+    json_append_int(jb, value);
+    jb->need_comma = 1;
+}
+
+void json_double(JsonBuilder *jb, double value) {
+    /* JSON has no NaN or infinity */
+    if (value != value || value > 1e308 || value < -1e308) value = 0;
+    if (jb->msgpack) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        mp_item(jb);
+        mp_tagged(jb, 0xcb, bits, 8);
+        return;
+    }
+    json_maybe_comma(jb);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.6g", value);
     json_append_str(jb, buf);
     jb->need_comma = 1;
 }
 
 void json_bool(JsonBuilder *jb, int value) {
+    if (jb->msgpack) {
+        mp_item(jb);
+        json_append(jb, value ? "\xc3" : "\xc2", 1);
+        return;
+    }
     json_maybe_comma(jb);
     json_append_str(jb, value ? "true" : "false");
     jb->need_comma = 1;
 }
 
 void json_null(JsonBuilder *jb) {
+    if (jb->msgpack) {
+        mp_item(jb);
+        json_append(jb, "\xc0", 1);
+        return;
+    }
     json_maybe_comma(jb);
     json_append_str(jb, "null");
     jb->need_comma = 1;
@@ -187,6 +602,12 @@ void json_kv_int(JsonBuilder *jb, const char *key, int value) {
     json_int(jb, value);
 }
 
+void json_kv_double(JsonBuilder *jb, const char *key, double value) {
+    json_key(jb, key);
+    jb->need_comma = 0;
+    json_double(jb, value);
+}
+
 void json_kv_bool(JsonBuilder *jb, const char *key, int value) {
     json_key(jb, key);
     jb->need_comma = 0;
@@ -195,10 +616,84 @@ void json_kv_bool(JsonBuilder *jb, const char *key, int value) {
 
 /* ======================= JSON Parser ======================================= */
 
+/* Nesting the parser follows before giving up */
+#define JSON_MAX_DEPTH 512
+
+/* Smallest arena block, and the most one grows to */
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_MAX_BLOCK (1024 * 1024)
+
+/* Keys an object has before lookups index it */
+#define JSON_INDEX_MIN 8
+
+typedef union {
+    void *p;
+    long long ll;
+    double d;
+} JsonAlign;
+
+typedef struct JsonArenaBlock {
+    struct JsonArenaBlock *next;
+    JsonAlign data[];
+} JsonArenaBlock;
+
+struct JsonArena {
+    JsonArenaBlock *blocks;     /* Newest first */
+    char *ptr;                  /* Free space in the newest */
+    size_t left;
+    size_t next_size;           /* Of the next block */
+};
+
+static JsonArena *arena_new(size_t hint) {
+    JsonArena *a = malloc(sizeof(*a));
+    if (!a) return NULL;
+    a->blocks = NULL;
+    a->ptr = NULL;
+    a->left = 0;
+    a->next_size = hint < ARENA_MIN_BLOCK ? ARENA_MIN_BLOCK : hint;
+    return a;
+}
+
+static void *arena_alloc(JsonArena *a, size_t size) {
+    size = (size + sizeof(JsonAlign) - 1) / sizeof(JsonAlign) * sizeof(JsonAlign);
+    if (size > a->left) {
+        size_t cap = a->next_size > size ? a->next_size : size;
+        JsonArenaBlock *b = malloc(sizeof(JsonArenaBlock) + cap);
+        if (!b) return NULL;
+        b->next = a->blocks;
+        a->blocks = b;
+        a->ptr = (char *)b->data;
+        a->left = cap;
+        if (a->next_size < ARENA_MAX_BLOCK) a->next_size *= 2;
+    }
+    void *mem = a->ptr;
+    a->ptr += size;
+    a->left -= size;
+    return mem;
+}
+
+static void arena_free_all(JsonArena *a) {
+    if (!a) return;
+    while (a->blocks) {
+        JsonArenaBlock *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    free(a);
+}
+
 typedef struct {
-    const char *json;
+    char *json;                 /* Strings are decoded in place */
     size_t pos;
     size_t len;
+    int depth;
+    JsonArena *arena;
+    /* Members of the open arrays and objects, copied to the arena as
+     * each closes, so it holds them at their final size */
+    JsonValue *stack;
+    char **keys;
+    size_t top;
+    size_t cap;
 } JsonParser;
 
 static void skip_whitespace(JsonParser *p) {
@@ -224,34 +719,33 @@ static int expect(JsonParser *p, char c) {
     return 1;
 }
 
+static int push(JsonParser *p, char *key, JsonValue val) {
+    if (p->top == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        JsonValue *stack = realloc(p->stack, cap * sizeof(JsonValue));
+        if (!stack) return 0;
+        p->stack = stack;
+        char **keys = realloc(p->keys, cap * sizeof(char *));
+        if (!keys) return 0;
+        p->keys = keys;
+        p->cap = cap;
+    }
+    p->keys[p->top] = key;
+    p->stack[p->top++] = val;
+    return 1;
+}
+
 static JsonValue parse_value(JsonParser *p);
 
+/* Strings never grow when decoded, so each is decoded over its own
+ * source and ends with a null where its closing quote was; one without
+ * escapes is left where it is. */
 static JsonValue parse_string(JsonParser *p) {
     JsonValue result = { .type = JSON_ERROR };
 
     if (!expect(p, '"')) return result;
 
-    size_t start = p->pos;
-    size_t len = 0;
-
-    /* First pass: count length */
-    while (p->pos < p->len && p->json[p->pos] != '"') {
-        if (p->json[p->pos] == '\\' && p->pos + 1 < p->len) {
-            p->pos += 2;
-            len++;
-        } else {
-            p->pos++;
-            len++;
-        }
-    }
-
-    if (p->pos >= p->len) return result;
-
-    /* Allocate and copy */
-    char *str = malloc(len + 1);
-    if (!str) return result;
-
-    p->pos = start;
+    char *str = p->json + p->pos;
     size_t out = 0;
 
     while (p->pos < p->len && p->json[p->pos] != '"') {
@@ -267,6 +761,7 @@ static JsonValue parse_string(JsonParser *p) {
                 case 't':  str[out++] = '\t'; break;
                 case 'u':
                     /* Skip unicode escapes for now */
+                    if (p->len - p->pos <= 4) return result;
                     p->pos += 4;
                     str[out++] = '?';
                     break;
@@ -279,12 +774,10 @@ static JsonValue parse_string(JsonParser *p) {
             str[out++] = p->json[p->pos++];
         }
     }
-    str[out] = '\0';
 
-    if (!expect(p, '"')) {
-        free(str);
-        return result;
-    }
+    if (p->pos >= p->len) return result;
+    p->json[p->pos++] = '\0';   /* The closing quote */
+    str[out] = '\0';
 
     result.type = JSON_STRING;
     result.data.string_val.str = str;
@@ -329,62 +822,66 @@ static JsonValue parse_number(JsonParser *p) {
     return result;
 }
 
-static JsonValue parse_array(JsonParser *p) {
-    JsonValue result = { .type = JSON_ERROR };
-
-    if (!expect(p, '[')) return result;
-
-    size_t cap = 8;
-    size_t count = 0;
-    JsonValue *items = malloc(cap * sizeof(JsonValue));
-    if (!items) return result;
+/* Parse the members of an array or object up to 'close' onto the stack.
+ * Returns how many, or -1 (and they are popped). */
+static long parse_members(JsonParser *p, int is_object, char close) {
+    size_t base = p->top;
 
     skip_whitespace(p);
-    if (peek(p) != ']') {
+    if (peek(p) != close) {
         while (1) {
-            if (count >= cap) {
-                cap *= 2;
-                JsonValue *new_items = realloc(items, cap * sizeof(JsonValue));
-                if (!new_items) {
-                    for (size_t i = 0; i < count; i++) {
-                        json_value_free(&items[i]);
-                    }
-                    free(items);
-                    return result;
-                }
-                items = new_items;
+            char *key = NULL;
+            if (is_object) {
+                JsonValue key_val = parse_string(p);
+                if (key_val.type != JSON_STRING) break;
+                key = key_val.data.string_val.str;
+                skip_whitespace(p);
+                if (!expect(p, ':')) break;
             }
 
-            items[count] = parse_value(p);
-            if (items[count].type == JSON_ERROR) {
-                for (size_t i = 0; i < count; i++) {
-                    json_value_free(&items[i]);
-                }
-                free(items);
-                return result;
-            }
-            count++;
+            JsonValue val = parse_value(p);
+            if (val.type == JSON_ERROR || !push(p, key, val)) break;
 
             skip_whitespace(p);
             if (peek(p) == ',') {
                 consume(p);
+            } else if (expect(p, close)) {
+                return (long)(p->top - base);
             } else {
                 break;
             }
         }
+    } else if (expect(p, close)) {
+        return 0;
     }
 
-    if (!expect(p, ']')) {
-        for (size_t i = 0; i < count; i++) {
-            json_value_free(&items[i]);
+    p->top = base;
+    return -1;
+}
+
+static JsonValue parse_array(JsonParser *p) {
+    JsonValue result = { .type = JSON_ERROR };
+
+    if (!expect(p, '[')) return result;
+
+    size_t base = p->top;
+    long count = parse_members(p, 0, ']');
+    if (count < 0) return result;
+
+    JsonValue *items = NULL;
+    if (count > 0) {
+        items = arena_alloc(p->arena, (size_t)count * sizeof(JsonValue));
+        if (!items) {
+            p->top = base;
+            return result;
         }
-        free(items);
-        return result;
+        memcpy(items, p->stack + base, (size_t)count * sizeof(JsonValue));
     }
+    p->top = base;
 
     result.type = JSON_ARRAY;
     result.data.array_val.items = items;
-    result.data.array_val.count = count;
+    result.data.array_val.count = (size_t)count;
     return result;
 }
 
@@ -393,96 +890,30 @@ static JsonValue parse_object(JsonParser *p) {
 
     if (!expect(p, '{')) return result;
 
-    size_t cap = 8;
-    size_t count = 0;
-    char **keys = malloc(cap * sizeof(char *));
-    JsonValue *values = malloc(cap * sizeof(JsonValue));
-    if (!keys || !values) {
-        free(keys);
-        free(values);
-        return result;
-    }
-
-    skip_whitespace(p);
-    if (peek(p) != '}') {
-        while (1) {
-            if (count >= cap) {
-                cap *= 2;
-                char **new_keys = realloc(keys, cap * sizeof(char *));
-                JsonValue *new_values = realloc(values, cap * sizeof(JsonValue));
-                if (!new_keys || !new_values) {
-                    for (size_t i = 0; i < count; i++) {
-                        free(keys[i]);
-                        json_value_free(&values[i]);
-                    }
-                    free(keys);
-                    free(values);
-                    return result;
-                }
-                keys = new_keys;
-                values = new_values;
-            }
-
-            JsonValue key_val = parse_string(p);
-            if (key_val.type != JSON_STRING) {
-                for (size_t i = 0; i < count; i++) {
-                    free(keys[i]);
-                    json_value_free(&values[i]);
-                }
-                free(keys);
-                free(values);
-                return result;
-            }
-            keys[count] = key_val.data.string_val.str;
-
-            skip_whitespace(p);
-            if (!expect(p, ':')) {
-                free(keys[count]);
-                for (size_t i = 0; i < count; i++) {
-                    free(keys[i]);
-                    json_value_free(&values[i]);
-                }
-                free(keys);
-                free(values);
-                return result;
-            }
-
-            values[count] = parse_value(p);
-            if (values[count].type == JSON_ERROR) {
-                free(keys[count]);
-                for (size_t i = 0; i < count; i++) {
-                    free(keys[i]);
-                    json_value_free(&values[i]);
-                }
-                free(keys);
-                free(values);
-                return result;
-            }
-            count++;
-
-            skip_whitespace(p);
-            if (peek(p) == ',') {
-                consume(p);
-            } else {
-                break;
-            }
-        }
-    }
-
-    if (!expect(p, '}')) {
-        for (size_t i = 0; i < count; i++) {
-            free(keys[i]);
-            json_value_free(&values[i]);
+    size_t base = p->top;
+    long count = parse_members(p, 1, '}');
+    if (count < 0) return result;
+
+    char **keys = NULL;
+    JsonValue *values = NULL;
+    if (count > 0) {
+        keys = arena_alloc(p->arena, (size_t)count * sizeof(char *));
+        values = arena_alloc(p->arena, (size_t)count * sizeof(JsonValue));
+        if (!keys || !values) {
+            p->top = base;
+            return result;
         }
-        free(keys);
-        free(values);
-        return result;
+        memcpy(keys, p->keys + base, (size_t)count * sizeof(char *));
+        memcpy(values, p->stack + base, (size_t)count * sizeof(JsonValue));
     }
+    p->top = base;
 
     result.type = JSON_OBJECT;
     result.data.object_val.keys = keys;
     result.data.object_val.values = values;
-    result.data.object_val.count = count;
+    result.data.object_val.count = (size_t)count;
+    result.data.object_val.index = NULL;
+    result.data.object_val.arena = p->arena;
     return result;
 }
 
@@ -496,23 +927,25 @@ static JsonValue parse_value(JsonParser *p) {
 
     if (c == '"') {
         return parse_string(p);
-    } else if (c == '{') {
-        return parse_object(p);
-    } else if (c == '[') {
-        return parse_array(p);
+    } else if (c == '{' || c == '[') {
+        if (p->depth >= JSON_MAX_DEPTH) return result;
+        p->depth++;
+        result = c == '{' ? parse_object(p) : parse_array(p);
+        p->depth--;
+        return result;
     } else if (c == '-' || isdigit(c)) {
         return parse_number(p);
-    } else if (strncmp(p->json + p->pos, "true", 4) == 0) {
+    } else if (p->len - p->pos >= 4 && strncmp(p->json + p->pos, "true", 4) == 0) {
         p->pos += 4;
         result.type = JSON_BOOL;
         result.data.bool_val = 1;
         return result;
-    } else if (strncmp(p->json + p->pos, "false", 5) == 0) {
+    } else if (p->len - p->pos >= 5 && strncmp(p->json + p->pos, "false", 5) == 0) {
         p->pos += 5;
         result.type = JSON_BOOL;
         result.data.bool_val = 0;
         return result;
-    } else if (strncmp(p->json + p->pos, "null", 4) == 0) {
+    } else if (p->len - p->pos >= 4 && strncmp(p->json + p->pos, "null", 4) == 0) {
         p->pos += 4;
         result.type = JSON_NULL;
         return result;
@@ -521,84 +954,306 @@ static JsonValue parse_value(JsonParser *p) {
     return result;
 }
 
-JsonValue json_parse(const char *json) {
-    JsonParser p = {
-        .json = json,
-        .pos = 0,
-        .len = strlen(json)
-    };
-    return parse_value(&p);
+int json_doc_parse_insitu(JsonDoc *doc, char *json, size_t len) {
+    doc->root.type = JSON_ERROR;
+    doc->arena = NULL;
+    if (!json) return -1;
+
+    /* Nodes take about as much as the text they came from */
+    JsonParser p;
+    p.json = json;
+    p.pos = 0;
+    p.len = len;
+    p.depth = 0;
+    p.arena = doc->arena = arena_new(len * 2);
+    p.stack = NULL;
+    p.keys = NULL;
+    p.top = 0;
+    p.cap = 0;
+    if (!p.arena) return -1;
+
+    doc->root = parse_value(&p);
+    free(p.stack);
+    free(p.keys);
+    return doc->root.type == JSON_ERROR ? -1 : 0;
 }
 
-void json_value_free(JsonValue *val) {
-    if (!val) return;
+int json_doc_parse(JsonDoc *doc, const char *json, size_t len) {
+    doc->root.type = JSON_ERROR;
+    doc->arena = NULL;
+    if (!json) return -1;
 
-    switch (val->type) {
-        case JSON_STRING:
-            free(val->data.string_val.str);
-            break;
-        case JSON_ARRAY:
-            for (size_t i = 0; i < val->data.array_val.count; i++) {
-                json_value_free(&val->data.array_val.items[i]);
-            }
-            free(val->data.array_val.items);
-            break;
-        case JSON_OBJECT:
-            for (size_t i = 0; i < val->data.object_val.count; i++) {
-                free(val->data.object_val.keys[i]);
-                json_value_free(&val->data.object_val.values[i]);
-            }
-            free(val->data.object_val.keys);
-            free(val->data.object_val.values);
-            break;
-        default:
-            break;
+    JsonArena *text = arena_new(len + 1);
+    char *copy = text ? arena_alloc(text, len + 1) : NULL;
+    if (!copy) {
+        arena_free_all(text);
+        return -1;
     }
+    memcpy(copy, json, len);
+    copy[len] = '\0';
 
-    val->type = JSON_NULL;
+    int rc = json_doc_parse_insitu(doc, copy, len);
+    if (!doc->arena) {
+        arena_free_all(text);
+        return -1;
+    }
+    /* The copy goes with the nodes */
+    JsonArenaBlock *last = text->blocks;
+    last->next = doc->arena->blocks;
+    doc->arena->blocks = last;
+    text->blocks = NULL;
+    arena_free_all(text);
+    return rc;
 }
 
-const char *json_object_get_string(const JsonValue *obj, const char *key) {
-    if (!obj || obj->type != JSON_OBJECT) return NULL;
+/* ======================= MessagePack Parser ================================ */
 
-    for (size_t i = 0; i < obj->data.object_val.count; i++) {
-        if (strcmp(obj->data.object_val.keys[i], key) == 0) {
-            JsonValue *v = &obj->data.object_val.values[i];
-            if (v->type == JSON_STRING) {
-                return v->data.string_val.str;
-            }
-            return NULL;
+typedef struct {
+    const unsigned char *data;
+    size_t pos;
+    size_t len;
+    int depth;
+    JsonArena *arena;
+} MsgpackParser;
+
+/* The next 'size' bytes as a big-endian number; 0 if there are fewer */
+static int mp_read(MsgpackParser *p, int size, uint64_t *v) {
+    if (p->len - p->pos < (size_t)size) return 0;
+    *v = 0;
+    for (int i = 0; i < size; i++) *v = *v << 8 | p->data[p->pos++];
+    return 1;
+}
+
+static int clamp_to_int(long long v) {
+    return v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : (int)v;
+}
+
+static JsonValue mp_value(MsgpackParser *p);
+
+static JsonValue mp_string(MsgpackParser *p, size_t n) {
+    JsonValue result = { .type = JSON_ERROR };
+    if (p->len - p->pos < n) return result;
+    char *str = arena_alloc(p->arena, n + 1);
+    if (!str) return result;
+    memcpy(str, p->data + p->pos, n);
+    str[n] = '\0';
+    p->pos += n;
+    result.type = JSON_STRING;
+    result.data.string_val.str = str;
+    result.data.string_val.len = n;
+    return result;
+}
+
+/* Every member takes a byte at least, which bounds what a count may ask
+ * to be allocated */
+static JsonValue mp_container(MsgpackParser *p, size_t n, int is_object) {
+    JsonValue result = { .type = JSON_ERROR };
+    if (n > (p->len - p->pos) / (is_object ? 2 : 1)) return result;
+    if (p->depth >= JSON_MAX_DEPTH) return result;
+    p->depth++;
+
+    JsonValue *values = NULL;
+    char **keys = NULL;
+    if (n > 0) {
+        values = arena_alloc(p->arena, n * sizeof(JsonValue));
+        if (is_object) keys = arena_alloc(p->arena, n * sizeof(char *));
+        if (!values || (is_object && !keys)) return result;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (is_object) {
+            JsonValue key = mp_value(p);
+            if (key.type != JSON_STRING) return result;
+            keys[i] = key.data.string_val.str;
         }
+        values[i] = mp_value(p);
+        if (values[i].type == JSON_ERROR) return result;
     }
-    return NULL;
+    p->depth--;
+
+    if (is_object) {
+        result.type = JSON_OBJECT;
+        result.data.object_val.keys = keys;
+        result.data.object_val.values = values;
+        result.data.object_val.count = n;
+        result.data.object_val.index = NULL;
+        result.data.object_val.arena = p->arena;
+    } else {
+        result.type = JSON_ARRAY;
+        result.data.array_val.items = values;
+        result.data.array_val.count = n;
+    }
+    return result;
 }
 
-int json_object_get_int(const JsonValue *obj, const char *key, int def) {
-    if (!obj || obj->type != JSON_OBJECT) return def;
+static JsonValue mp_value(MsgpackParser *p) {
+    JsonValue result = { .type = JSON_ERROR };
+    if (p->pos >= p->len) return result;
+
+    unsigned char c = p->data[p->pos++];
+    uint64_t v;
 
-    for (size_t i = 0; i < obj->data.object_val.count; i++) {
-        if (strcmp(obj->data.object_val.keys[i], key) == 0) {
-            JsonValue *v = &obj->data.object_val.values[i];
-            if (v->type == JSON_INT) {
-                return v->data.int_val;
+    if (c < 0x80 || c >= 0xe0) {
+        result.type = JSON_INT;
+        result.data.int_val = c >= 0xe0 ? (int)c - 256 : c;
+        return result;
+    }
+    if ((c & 0xe0) == 0xa0) return mp_string(p, c & 0x1f);
+    if ((c & 0xf0) == 0x90) return mp_container(p, c & 0x0f, 0);
+    if ((c & 0xf0) == 0x80) return mp_container(p, c & 0x0f, 1);
+
+    switch (c) {
+        case 0xc0:
+            result.type = JSON_NULL;
+            return result;
+        case 0xc2:
+        case 0xc3:
+            result.type = JSON_BOOL;
+            result.data.bool_val = c == 0xc3;
+            return result;
+        case 0xc4: case 0xd9:   /* bin 8, str 8 */
+            return mp_read(p, 1, &v) ? mp_string(p, v) : result;
+        case 0xc5: case 0xda:
+            return mp_read(p, 2, &v) ? mp_string(p, v) : result;
+        case 0xc6: case 0xdb:
+            return mp_read(p, 4, &v) ? mp_string(p, v) : result;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+            if (!mp_read(p, 1 << (c - 0xcc), &v)) return result;
+            result.type = JSON_INT;
+            result.data.int_val = v > INT_MAX ? INT_MAX : (int)v;
+            return result;
+        }
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+            int size = 1 << (c - 0xd0);
+            if (!mp_read(p, size, &v)) return result;
+            /* Sign-extend from 'size' bytes */
+            if (size < 8 && (v >> (8 * size - 1)) & 1) v |= ~(uint64_t)0 << (8 * size);
+            result.type = JSON_INT;
+            result.data.int_val = clamp_to_int((long long)v);
+            return result;
+        }
+        case 0xca: case 0xcb: {
+            double d;
+            if (c == 0xca) {
+                float f;
+                uint32_t bits;
+                if (!mp_read(p, 4, &v)) return result;
+                bits = (uint32_t)v;
+                memcpy(&f, &bits, sizeof(f));
+                d = f;
+            } else {
+                if (!mp_read(p, 8, &v)) return result;
+                memcpy(&d, &v, sizeof(d));
             }
-            return def;
+            result.type = JSON_INT;
+            result.data.int_val = d != d ? 0 : d >= INT_MAX ? INT_MAX :
+                                  d <= INT_MIN ? INT_MIN : (int)d;
+            return result;
         }
+        case 0xdc: case 0xdd:
+            return mp_read(p, c == 0xdc ? 2 : 4, &v) ? mp_container(p, v, 0) : result;
+        case 0xde: case 0xdf:
+            return mp_read(p, c == 0xde ? 2 : 4, &v) ? mp_container(p, v, 1) : result;
+        default:
+            return result;      /* Extension types, and 0xc1 (never used) */
     }
-    return def;
 }
 
-int json_object_get_bool(const JsonValue *obj, const char *key, int def) {
-    if (!obj || obj->type != JSON_OBJECT) return def;
+int json_doc_parse_msgpack(JsonDoc *doc, const char *data, size_t len) {
+    doc->root.type = JSON_ERROR;
+    doc->arena = NULL;
+    if (!data) return -1;
+
+    MsgpackParser p;
+    p.data = (const unsigned char *)data;
+    p.pos = 0;
+    p.len = len;
+    p.depth = 0;
+    p.arena = doc->arena = arena_new(len * 2);
+    if (!p.arena) return -1;
+
+    doc->root = mp_value(&p);
+    if (doc->root.type != JSON_ERROR && p.pos != len) doc->root.type = JSON_ERROR;
+    return doc->root.type == JSON_ERROR ? -1 : 0;
+}
 
-    for (size_t i = 0; i < obj->data.object_val.count; i++) {
-        if (strcmp(obj->data.object_val.keys[i], key) == 0) {
-            JsonValue *v = &obj->data.object_val.values[i];
-            if (v->type == JSON_BOOL) {
-                return v->data.bool_val;
-            }
-            return def;
+void json_doc_free(JsonDoc *doc) {
+    if (!doc) return;
+    arena_free_all(doc->arena);
+    doc->arena = NULL;
+    doc->root.type = JSON_NULL;
+}
+
+/* ======================= JSON Lookup ======================================= */
+
+static uint32_t key_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *k = (const unsigned char *)key; *k; k++) {
+        h ^= *k;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slots of an object's index: a power of 2, at least twice its keys */
+static size_t index_slots(size_t count) {
+    size_t slots = 16;
+    while (slots < count * 2) slots *= 2;
+    return slots;
+}
+
+/* Index an object's keys: slots holding 1 + the member's position, or 0.
+ * The first of duplicate keys is the one found, as when scanning. */
+static void build_index(JsonValue *obj) {
+    size_t count = obj->data.object_val.count;
+    size_t mask = index_slots(count) - 1;
+    unsigned int *index = arena_alloc(obj->data.object_val.arena, (mask + 1) * sizeof(*index));
+    if (!index) return;
+    memset(index, 0, (mask + 1) * sizeof(*index));
+    char **keys = obj->data.object_val.keys;
+    for (size_t i = 0; i < count; i++) {
+        size_t at = key_hash(keys[i]) & mask;
+        while (index[at] && strcmp(keys[index[at] - 1], keys[i]) != 0) at = (at + 1) & mask;
+        if (!index[at]) index[at] = (unsigned int)(i + 1);
+    }
+    obj->data.object_val.index = index;
+}
+
+const JsonValue *json_object_get(const JsonValue *obj, const char *key) {
+    if (!obj || obj->type != JSON_OBJECT) return NULL;
+
+    size_t count = obj->data.object_val.count;
+    char **keys = obj->data.object_val.keys;
+    if (count >= JSON_INDEX_MIN && !obj->data.object_val.index && obj->data.object_val.arena) {
+        /* The index is a cache: built on first use, for const objects too */
+        build_index((JsonValue *)obj);
+    }
+    const unsigned int *index = obj->data.object_val.index;
+    if (index) {
+        size_t mask = index_slots(count) - 1;
+        for (size_t at = key_hash(key) & mask; index[at]; at = (at + 1) & mask) {
+            if (strcmp(keys[index[at] - 1], key) == 0)
+                return &obj->data.object_val.values[index[at] - 1];
         }
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(keys[i], key) == 0) return &obj->data.object_val.values[i];
     }
-    return def;
+    return NULL;
+}
+
+const char *json_object_get_string(const JsonValue *obj, const char *key) {
+    const JsonValue *v = json_object_get(obj, key);
+    return v && v->type == JSON_STRING ? v->data.string_val.str : NULL;
+}
+
+int json_object_get_int(const JsonValue *obj, const char *key, int def) {
+    const JsonValue *v = json_object_get(obj, key);
+    return v && v->type == JSON_INT ? v->data.int_val : def;
+}
+
+int json_object_get_bool(const JsonValue *obj, const char *key, int def) {
+    const JsonValue *v = json_object_get(obj, key);
+    return v && v->type == JSON_BOOL ? v->data.bool_val : def;
 }
@@ -3,12 +3,18 @@
  * This module provides lightweight JSON handling for the JSON-RPC harness.
  * Not a general-purpose JSON library - only handles the specific types
  * needed for editor commands and view model serialization.
+ *
+ * The same builder calls and parsed values also serve MessagePack, for
+ * the harness's binary format: a builder made with
+ * json_builder_init_msgpack() writes it, and json_doc_parse_msgpack()
+ * reads it into the same JsonValue tree.
  */
 
 #ifndef LOKI_JSON_H
 #define LOKI_JSON_H
 
 #include <stddef.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,21 +22,55 @@ extern "C" {
 
 /* ======================= JSON Builder ====================================== */
 
+/* Nesting a MessagePack builder follows before giving up */
+#define JSON_BUILDER_MAX_DEPTH 64
+
+/* Strings this long and longer are kept by json_string_ref() in
+ * MessagePack, not copied */
+#define JSON_REF_MIN 32
+
+/* A string of the output kept by reference: it goes at 'at' in buf */
+typedef struct {
+    size_t at;
+    const char *text;
+    size_t len;
+} JsonBuilderRef;
+
+/* A MessagePack map or array being written */
+typedef struct {
+    size_t at;          /* Of its header in buf */
+    unsigned int count; /* Keys or items so far */
+    int is_array;
+    size_t refs;        /* ref_count when it started */
+} JsonBuilderOpen;
+
 /**
  * JsonBuilder - Accumulates JSON output into a growable buffer.
  */
 typedef struct {
-    char *buf;          /* Output buffer (owned) */
+    char *buf;          /* Output buffer (owned; NULL until written) */
     size_t len;         /* Current length */
     size_t cap;         /* Allocated capacity */
     int error;          /* Error flag (allocation failure) */
     int depth;          /* Nesting depth for indentation */
     int need_comma;     /* Need comma before next element */
+    int msgpack;        /* Writing MessagePack instead */
+    JsonBuilderOpen open[JSON_BUILDER_MAX_DEPTH];
+    JsonBuilderRef *refs;   /* MessagePack strings kept by reference */
+    size_t ref_count;
+    size_t ref_cap;
 } JsonBuilder;
 
 /* Initialize a JSON builder */
 void json_builder_init(JsonBuilder *jb);
 
+/* Initialize a builder writing MessagePack: buf then holds binary data,
+ * not a string, and strings of json_string_ref() may be kept apart from
+ * it (see json_builder_iov()). Maps and arrays are written with 32-bit
+ * counts while open, and shortened when they close if no string inside
+ * was kept by reference. */
+void json_builder_init_msgpack(JsonBuilder *jb);
+
 /* Free JSON builder resources */
 void json_builder_free(JsonBuilder *jb);
 
@@ -40,6 +80,28 @@ const char *json_builder_get(JsonBuilder *jb);
 /* Reset builder for reuse */
 void json_builder_reset(JsonBuilder *jb);
 
+/* Make room for 'extra' more bytes of output in one allocation, so that
+ * writing up to that much allocates nothing. Writing more grows the
+ * buffer as usual. */
+void json_builder_reserve(JsonBuilder *jb, size_t extra);
+
+/* The built JSON string, handed over to the caller to free(); the
+ * builder is left empty. Returns NULL on error. */
+char *json_builder_take(JsonBuilder *jb);
+
+/* Bytes of output, strings kept by reference included */
+size_t json_builder_size(const JsonBuilder *jb);
+
+/* The output as pieces for writev(): runs of buf between the strings kept
+ * by reference, and those strings, in order. Returns how many pieces
+ * there are; no more than 'max' are filled in (2 * ref_count + 1 are
+ * enough). */
+int json_builder_iov(const JsonBuilder *jb, struct iovec *iov, int max);
+
+/* The output in one malloc()ed block, its size in 'len'. Returns NULL on
+ * error. */
+char *json_builder_flatten(const JsonBuilder *jb, size_t *len);
+
 /* ======================= JSON Writing ====================================== */
 
 /* Start an object: { */
@@ -63,9 +125,16 @@ void json_string(JsonBuilder *jb, const char *value);
 /* Write string value with explicit length (handles embedded nulls) */
 void json_string_len(JsonBuilder *jb, const char *value, size_t len);
 
+/* As json_string_len(), but in MessagePack a long string is not copied:
+ * 'value' must then stay as it is until the output is written. */
+void json_string_ref(JsonBuilder *jb, const char *value, size_t len);
+
 /* Write integer value */
 void json_int(JsonBuilder *jb, int value);
 
+/* Write floating point value (NaN and infinities are written as 0) */
+void json_double(JsonBuilder *jb, double value);
+
 /* Write boolean value */
 void json_bool(JsonBuilder *jb, int value);
 
@@ -78,6 +147,9 @@ void json_kv_string(JsonBuilder *jb, const char *key, const char *value);
 /* Convenience: write key-value pair with integer value */
 void json_kv_int(JsonBuilder *jb, const char *key, int value);
 
+/* Convenience: write key-value pair with floating point value */
+void json_kv_double(JsonBuilder *jb, const char *key, double value);
+
 /* Convenience: write key-value pair with boolean value */
 void json_kv_bool(JsonBuilder *jb, const char *key, int value);
 
@@ -101,6 +173,7 @@ typedef enum {
 } JsonType;
 
 typedef struct JsonValue JsonValue;
+typedef struct JsonArena JsonArena;
 
 struct JsonValue {
     JsonType type;
@@ -108,7 +181,7 @@ struct JsonValue {
         int bool_val;
         int int_val;
         struct {
-            char *str;
+            char *str;          /* Null-terminated, in the parsed text */
             size_t len;
         } string_val;
         struct {
@@ -119,15 +192,41 @@ struct JsonValue {
             char **keys;
             JsonValue *values;
             size_t count;
+            unsigned int *index;    /* Hash of the keys, built by the first lookup */
+            JsonArena *arena;       /* That the index is allocated from */
         } object_val;
     } data;
 };
 
-/* Parse JSON string into JsonValue. Returns JSON_ERROR on failure. */
-JsonValue json_parse(const char *json);
-
-/* Free parsed JSON value and all children */
-void json_value_free(JsonValue *val);
+/**
+ * JsonDoc - A parsed document: its values, and the arena they live in.
+ */
+typedef struct {
+    JsonValue root;     /* JSON_ERROR if parsing failed */
+    JsonArena *arena;   /* Every node, string and index of it */
+} JsonDoc;
+
+/* Parse 'len' bytes of 'json' into 'doc', copying the text into its arena.
+ * Returns 0, or -1 on failure. Free with json_doc_free() either way. */
+int json_doc_parse(JsonDoc *doc, const char *json, size_t len);
+
+/* Parse 'len' bytes of 'json' in place: strings are decoded over the text
+ * and point into it, so it must outlive 'doc'. Returns 0, or -1. */
+int json_doc_parse_insitu(JsonDoc *doc, char *json, size_t len);
+
+/* Parse exactly one MessagePack value of 'len' bytes into 'doc', strings
+ * copied (and null-terminated) into its arena. Binary data is read as a
+ * string, floats and integers as JSON_INT (truncated and clamped to an
+ * int); map keys must be strings, and extension types are refused.
+ * Returns 0, or -1 on failure. Free with json_doc_free() either way. */
+int json_doc_parse_msgpack(JsonDoc *doc, const char *data, size_t len);
+
+/* Free every value of the document in one go */
+void json_doc_free(JsonDoc *doc);
+
+/* Get the value of 'key' in an object (NULL if not found or not an object).
+ * Objects of more than a few keys are hashed on first lookup. */
+const JsonValue *json_object_get(const JsonValue *obj, const char *key);
 
 /* Get string value from object by key (returns NULL if not found or wrong type) */
 const char *json_object_get_string(const JsonValue *obj, const char *key);
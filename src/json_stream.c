@@ -0,0 +1,642 @@
+/* json_stream.c - Push parser for JSON that arrives in pieces
+ *
+ * See json_stream.h for an overview. The parser is a state machine over
+ * bytes that can stop anywhere, strings and numbers included: what a token
+ * has so far waits in a buffer for the next piece. Runs of plain string
+ * bytes, and the insides of skipped values, are not looked at one byte at
+ * a time: a block scan finds the next byte that matters (a quote or
+ * backslash in a string; a quote or bracket outside one).
+ */
+
+#include "json_stream.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_USE_SSE2 1
+#endif
+
+typedef enum {
+    ST_TOP,             /* Between top-level values */
+    ST_FIRST_ITEM,      /* After '[': a value or ']' */
+    ST_FIRST_KEY,       /* After '{': a key or '}' */
+    ST_KEY,             /* After ',' in an object */
+    ST_COLON,
+    ST_VALUE,           /* After ',' in an array, or ':' */
+    ST_AFTER,           /* After a member: ',' or the close */
+    ST_STRING,
+    ST_NUMBER,
+    ST_LITERAL,
+    ST_SKIP
+} StreamState;
+
+typedef struct {
+    char type;          /* '{' or '[' */
+    size_t count;       /* Members before the current one */
+    size_t key_at;      /* Where its current key is in 'keys' */
+} StreamFrame;
+
+struct JsonStream {
+    JsonStreamFn fn;
+    void *opaque;
+    StreamState state;
+    int error;
+    int stopped;
+
+    StreamFrame *frames;
+    int depth;
+    int frames_cap;
+    char *keys;         /* The current key of each open object, null-terminated */
+    size_t keys_len;
+    size_t keys_cap;
+
+    /* The token being read */
+    char *tok;
+    size_t tok_len;
+    size_t tok_cap;
+    int tok_is_key;
+    int esc;            /* 1 after a backslash; 2-5 in the digits of \u */
+    unsigned code;      /* Of the \u escape being read */
+    unsigned high;      /* A high surrogate, waiting for its low half */
+    const char *lit;    /* "true", "false" or "null" */
+    size_t lit_at;
+
+    /* Skipping a value, and keeping its text if capturing */
+    size_t skip_depth;
+    int skip_str;
+    int skip_esc;
+    int want;           /* 1 to skip, 2 to capture: set by the callback */
+    int capturing;
+    char *cap;
+    size_t cap_len;
+    size_t cap_cap;
+};
+
+static int grow(JsonStream *s, char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t ncap = *cap ? *cap : 256;
+    while (ncap < need) ncap *= 2;
+    char *nbuf = realloc(*buf, ncap);
+    if (!nbuf) {
+        s->error = 1;
+        return -1;
+    }
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+
+static int append(JsonStream *s, char **buf, size_t *len, size_t *cap,
+                  const char *data, size_t n) {
+    if (grow(s, buf, cap, *len + n + 1) != 0) return -1;
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+/* Start a string token, empty but null-terminated */
+static void start_string(JsonStream *s, int is_key) {
+    s->tok_len = 0;
+    s->tok_is_key = is_key;
+    s->esc = 0;
+    s->high = 0;
+    s->state = ST_STRING;
+    if (grow(s, &s->tok, &s->tok_cap, 1) == 0) s->tok[0] = '\0';
+}
+
+static void emit(JsonStream *s, JsonEvent ev, const char *text, size_t len) {
+    if (s->fn(s->opaque, s, ev, text, len) != 0) s->stopped = 1;
+}
+
+JsonStream *json_stream_new(JsonStreamFn fn, void *opaque) {
+    if (!fn) return NULL;
+    JsonStream *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->fn = fn;
+    s->opaque = opaque;
+    s->state = ST_TOP;
+    return s;
+}
+
+void json_stream_free(JsonStream *s) {
+    if (!s) return;
+    free(s->frames);
+    free(s->keys);
+    free(s->tok);
+    free(s->cap);
+    free(s);
+}
+
+void json_stream_reset(JsonStream *s) {
+    s->state = ST_TOP;
+    s->error = 0;
+    s->stopped = 0;
+    s->depth = 0;
+    s->keys_len = 0;
+    s->tok_len = 0;
+    s->esc = 0;
+    s->high = 0;
+    s->want = 0;
+    s->capturing = 0;
+    s->cap_len = 0;
+}
+
+/* ======================= Block Scans ======================================= */
+
+#ifndef JSON_USE_SSE2
+/* Bit 7 set in each byte of 'w' that is zero */
+static uint64_t zero_bytes(uint64_t w) {
+    const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((w & low) + low) | w | low);
+}
+
+static uint64_t load_word(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+#if defined(__GNUC__)
+#define word_first(m) ((size_t)__builtin_ctzll(m) / 8)
+#else
+static size_t word_first(uint64_t m) {
+    size_t n = 0;
+    while (!(m & 0x80)) { m >>= 8; n++; }
+    return n;
+}
+#endif
+#endif
+
+/* Offset of the first '"' or '\\' in [i, len), or len */
+static size_t find_quote(const char *data, size_t i, size_t len) {
+#ifdef JSON_USE_SSE2
+    const __m128i quote = _mm_set1_epi8('"'), slash = _mm_set1_epi8('\\');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                               _mm_cmpeq_epi8(v, slash)));
+        if (m) return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = load_word(data + i);
+        uint64_t m = zero_bytes(w ^ (ones * '"')) | zero_bytes(w ^ (ones * '\\'));
+        if (m) return i + word_first(m);
+    }
+#endif
+    while (i < len && data[i] != '"' && data[i] != '\\') i++;
+    return i;
+}
+
+/* Offset of the first quote or bracket in [i, len), or len */
+static size_t find_structural(const char *data, size_t i, size_t len) {
+#ifdef JSON_USE_SSE2
+    /* '['/'{' and ']'/'}' differ only in bit 5 */
+    const __m128i quote = _mm_set1_epi8('"'), bit5 = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i folded = _mm_or_si128(v, bit5);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                   _mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                                                _mm_cmpeq_epi8(folded, close)));
+        int m = _mm_movemask_epi8(hit);
+        if (m) return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = load_word(data + i), folded = w | (ones * 0x20);
+        uint64_t m = zero_bytes(w ^ (ones * '"')) | zero_bytes(folded ^ (ones * '{')) |
+                     zero_bytes(folded ^ (ones * '}'));
+        if (m) return i + word_first(m);
+    }
+#endif
+    while (i < len && data[i] != '"' && (data[i] | 0x20) != '{' && (data[i] | 0x20) != '}')
+        i++;
+    return i;
+}
+
+/* ======================= Values ============================================ */
+
+/* A value ended: on to what follows it */
+static void value_done(JsonStream *s) {
+    if (s->depth == 0) {
+        s->state = ST_TOP;
+    } else {
+        s->frames[s->depth - 1].count++;
+        s->state = ST_AFTER;
+    }
+}
+
+static void start_container(JsonStream *s, char c) {
+    s->want = 0;
+    emit(s, c == '{' ? JSON_EV_OBJECT_START : JSON_EV_ARRAY_START, NULL, 0);
+    if (s->stopped) return;
+    if (s->want) {
+        s->state = ST_SKIP;
+        s->skip_depth = 1;
+        s->skip_str = 0;
+        s->skip_esc = 0;
+        s->capturing = s->want == 2;
+        s->cap_len = 0;
+        if (s->capturing) append(s, &s->cap, &s->cap_len, &s->cap_cap, &c, 1);
+        s->want = 0;
+        return;
+    }
+    if (s->depth >= JSON_STREAM_MAX_DEPTH) {
+        s->error = 1;
+        return;
+    }
+    if (s->depth == s->frames_cap) {
+        int ncap = s->frames_cap ? s->frames_cap * 2 : 16;
+        StreamFrame *frames = realloc(s->frames, sizeof(StreamFrame) * (size_t)ncap);
+        if (!frames) {
+            s->error = 1;
+            return;
+        }
+        s->frames = frames;
+        s->frames_cap = ncap;
+    }
+    StreamFrame *f = &s->frames[s->depth++];
+    f->type = c;
+    f->count = 0;
+    f->key_at = s->keys_len;
+    s->state = c == '{' ? ST_FIRST_KEY : ST_FIRST_ITEM;
+}
+
+static void end_container(JsonStream *s, char c) {
+    StreamFrame *f = &s->frames[s->depth - 1];
+    if ((c == '}') != (f->type == '{')) {
+        s->error = 1;
+        return;
+    }
+    s->keys_len = f->key_at;
+    s->depth--;
+    emit(s, c == '}' ? JSON_EV_OBJECT_END : JSON_EV_ARRAY_END, NULL, 0);
+    value_done(s);
+}
+
+/* Start reading a value at 'c', which is not whitespace */
+static void start_value(JsonStream *s, char c) {
+    s->tok_len = 0;
+    if (c == '{' || c == '[') {
+        start_container(s, c);
+    } else if (c == '"') {
+        start_string(s, 0);
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        append(s, &s->tok, &s->tok_len, &s->tok_cap, &c, 1);
+        s->state = ST_NUMBER;
+    } else if (c == 't' || c == 'f' || c == 'n') {
+        s->lit = c == 't' ? "true" : c == 'f' ? "false" : "null";
+        s->lit_at = 1;
+        s->state = ST_LITERAL;
+    } else {
+        s->error = 1;
+    }
+}
+
+static int number_valid(const char *p) {
+    if (*p == '-') p++;
+    if (*p == '0') {
+        p++;
+    } else if (*p >= '1' && *p <= '9') {
+        while (*p >= '0' && *p <= '9') p++;
+    } else {
+        return 0;
+    }
+    if (*p == '.') {
+        p++;
+        if (!(*p >= '0' && *p <= '9')) return 0;
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') p++;
+        if (!(*p >= '0' && *p <= '9')) return 0;
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    return *p == '\0';
+}
+
+static void end_number(JsonStream *s) {
+    if (!number_valid(s->tok)) {
+        s->error = 1;
+        return;
+    }
+    emit(s, JSON_EV_NUMBER, s->tok, s->tok_len);
+    value_done(s);
+}
+
+/* ======================= Strings =========================================== */
+
+static void put_utf8(JsonStream *s, unsigned c) {
+    char buf[4];
+    size_t n;
+    if (c < 0x80) {
+        buf[0] = (char)c;
+        n = 1;
+    } else if (c < 0x800) {
+        buf[0] = (char)(0xC0 | (c >> 6));
+        buf[1] = (char)(0x80 | (c & 0x3F));
+        n = 2;
+    } else if (c < 0x10000) {
+        buf[0] = (char)(0xE0 | (c >> 12));
+        buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (c & 0x3F));
+        n = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (c >> 18));
+        buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (c & 0x3F));
+        n = 4;
+    }
+    append(s, &s->tok, &s->tok_len, &s->tok_cap, buf, n);
+}
+
+/* A high surrogate not followed by its low half stands for U+FFFD */
+static void flush_high(JsonStream *s) {
+    if (!s->high) return;
+    s->high = 0;
+    put_utf8(s, 0xFFFD);
+}
+
+static void escaped_code(JsonStream *s) {
+    unsigned c = s->code;
+    if (c >= 0xDC00 && c <= 0xDFFF) {
+        if (s->high) {
+            c = 0x10000 + ((s->high - 0xD800) << 10) + (c - 0xDC00);
+            s->high = 0;
+        } else {
+            c = 0xFFFD;
+        }
+    } else {
+        flush_high(s);
+        if (c >= 0xD800 && c <= 0xDBFF) {
+            s->high = c;
+            return;
+        }
+    }
+    put_utf8(s, c);
+}
+
+static void end_string(JsonStream *s) {
+    flush_high(s);
+    if (s->error) return;
+    if (s->tok_is_key) {
+        StreamFrame *f = &s->frames[s->depth - 1];
+        s->keys_len = f->key_at;
+        append(s, &s->keys, &s->keys_len, &s->keys_cap, s->tok, s->tok_len + 1);
+        emit(s, JSON_EV_KEY, s->tok, s->tok_len);
+        s->state = ST_COLON;
+    } else {
+        emit(s, JSON_EV_STRING, s->tok, s->tok_len);
+        value_done(s);
+    }
+}
+
+/* Read string bytes from data[i]; returns where it stopped */
+static size_t scan_string(JsonStream *s, const char *data, size_t i, size_t len) {
+    while (i < len && !s->error) {
+        char c = data[i];
+        if (s->esc == 1) {
+            static const char from[] = "\"\\/bfnrt", to[] = "\"\\/\b\f\n\r\t";
+            const char *at = c ? strchr(from, c) : NULL;
+            i++;
+            if (c == 'u') {
+                s->esc = 2;
+                s->code = 0;
+                continue;
+            }
+            if (!at) {
+                s->error = 1;
+                break;
+            }
+            s->esc = 0;
+            flush_high(s);
+            append(s, &s->tok, &s->tok_len, &s->tok_cap, &to[at - from], 1);
+        } else if (s->esc >= 2) {
+            int d = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            i++;
+            if (d < 0) {
+                s->error = 1;
+                break;
+            }
+            s->code = s->code << 4 | (unsigned)d;
+            if (++s->esc == 6) {
+                s->esc = 0;
+                escaped_code(s);
+            }
+        } else {
+            size_t j = find_quote(data, i, len);
+            if (j > i) {
+                flush_high(s);
+                append(s, &s->tok, &s->tok_len, &s->tok_cap, data + i, j - i);
+            }
+            i = j;
+            if (i == len) break;
+            i++;
+            if (data[i - 1] == '\\') {
+                s->esc = 1;
+            } else {
+                end_string(s);
+                break;
+            }
+        }
+    }
+    return i;
+}
+
+/* ======================= Skipping ========================================== */
+
+/* Go through a skipped value from data[i]; returns where it stopped */
+static size_t scan_skip(JsonStream *s, const char *data, size_t i, size_t len) {
+    size_t from = i;
+    while (i < len && s->skip_depth > 0) {
+        if (s->skip_esc) {
+            s->skip_esc = 0;
+            i++;
+        } else if (s->skip_str) {
+            i = find_quote(data, i, len);
+            if (i == len) break;
+            if (data[i] == '"')
+                s->skip_str = 0;
+            else
+                s->skip_esc = 1;
+            i++;
+        } else {
+            i = find_structural(data, i, len);
+            if (i == len) break;
+            char c = data[i++];
+            if (c == '"')
+                s->skip_str = 1;
+            else if (c == '{' || c == '[')
+                s->skip_depth++;
+            else
+                s->skip_depth--;
+        }
+    }
+    if (s->capturing) append(s, &s->cap, &s->cap_len, &s->cap_cap, data + from, i - from);
+    if (s->skip_depth == 0 && !s->error) {
+        if (s->capturing) {
+            s->capturing = 0;
+            emit(s, JSON_EV_VALUE, s->cap, s->cap_len);
+        }
+        value_done(s);
+    }
+    return i;
+}
+
+/* ======================= Feeding =========================================== */
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+int json_stream_feed(JsonStream *s, const char *data, size_t len) {
+    if (s->error) return -1;
+    if (s->stopped) return 1;
+
+    size_t i = 0;
+    while (i < len && !s->error && !s->stopped) {
+        char c = data[i];
+        switch (s->state) {
+        case ST_STRING:
+            i = scan_string(s, data, i, len);
+            continue;
+        case ST_SKIP:
+            i = scan_skip(s, data, i, len);
+            continue;
+        case ST_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' ||
+                c == '+' || c == '-') {
+                append(s, &s->tok, &s->tok_len, &s->tok_cap, &c, 1);
+                i++;
+            } else {
+                end_number(s);      /* And 'c' is read again after it */
+            }
+            continue;
+        case ST_LITERAL:
+            if (c != s->lit[s->lit_at]) {
+                s->error = 1;
+                continue;
+            }
+            i++;
+            if (s->lit[++s->lit_at] == '\0') {
+                JsonEvent ev = s->lit[0] == 't' ? JSON_EV_TRUE
+                             : s->lit[0] == 'f' ? JSON_EV_FALSE : JSON_EV_NULL;
+                emit(s, ev, s->lit, s->lit_at);
+                value_done(s);
+            }
+            continue;
+        default:
+            break;
+        }
+
+        i++;
+        if (is_space(c)) continue;
+        switch (s->state) {
+        case ST_TOP:
+        case ST_VALUE:
+            start_value(s, c);
+            break;
+        case ST_FIRST_ITEM:
+            if (c == ']')
+                end_container(s, c);
+            else
+                start_value(s, c);
+            break;
+        case ST_FIRST_KEY:
+        case ST_KEY:
+            if (c == '}' && s->state == ST_FIRST_KEY) {
+                end_container(s, c);
+            } else if (c == '"') {
+                start_string(s, 1);
+            } else {
+                s->error = 1;
+            }
+            break;
+        case ST_COLON:
+            if (c == ':')
+                s->state = ST_VALUE;
+            else
+                s->error = 1;
+            break;
+        case ST_AFTER:
+            if (c == ',')
+                s->state = s->frames[s->depth - 1].type == '{' ? ST_KEY : ST_VALUE;
+            else if (c == '}' || c == ']')
+                end_container(s, c);
+            else
+                s->error = 1;
+            break;
+        default:
+            break;
+        }
+    }
+    if (s->error) return -1;
+    return s->stopped ? 1 : 0;
+}
+
+int json_stream_finish(JsonStream *s) {
+    if (s->error) return -1;
+    if (s->state == ST_NUMBER && s->depth == 0 && !s->stopped) end_number(s);
+    return !s->error && s->state == ST_TOP ? 0 : -1;
+}
+
+int json_stream_idle(const JsonStream *s) {
+    return s->state == ST_TOP;
+}
+
+/* ======================= Where We Are ====================================== */
+
+int json_stream_depth(const JsonStream *s) {
+    return s->depth;
+}
+
+int json_stream_at(const JsonStream *s, const char *path) {
+    const char *p = path;
+    for (int d = 0; d < s->depth; d++) {
+        if (d > 0) {
+            if (*p != '.') return 0;
+            p++;
+        } else if (*p == '\0') {
+            return 0;
+        }
+        size_t n = strcspn(p, ".");
+        const StreamFrame *f = &s->frames[d];
+        if (f->type == '{') {
+            const char *key = s->keys + f->key_at;
+            if (f->key_at >= s->keys_len || strlen(key) != n || memcmp(key, p, n) != 0)
+                return 0;
+        } else {
+            size_t index = 0;
+            if (n == 0) return 0;
+            for (size_t k = 0; k < n; k++) {
+                if (p[k] < '0' || p[k] > '9') return 0;
+                index = index * 10 + (size_t)(p[k] - '0');
+            }
+            if (index != f->count) return 0;
+        }
+        p += n;
+    }
+    return *p == '\0';
+}
+
+void json_stream_skip(JsonStream *s) {
+    s->want = 1;
+}
+
+void json_stream_capture(JsonStream *s) {
+    s->want = 2;
+}
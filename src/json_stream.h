@@ -0,0 +1,95 @@
+/* json_stream.h - Push parser for JSON that arrives in pieces
+ *
+ * json_stream_feed() takes the text a piece at a time, cut anywhere (a
+ * chunk of an HTTP response, a read() of a pipe), and reports what it
+ * finds as it goes, to a callback: the start and end of each object and
+ * array, each key, and each string, number and literal. Nothing is kept
+ * of what was reported, so memory use is the nesting and the longest
+ * string's, not the document's. A stream takes any number of values one
+ * after another ("ndjson").
+ *
+ * To pick a few fields out of a large document, the callback checks where
+ * it is with json_stream_at() ("result.items.3.name") and, at the start
+ * of an object or array it has no use for, calls json_stream_skip(): its
+ * inside is then scanned for brackets and quotes only, 16 bytes at a time
+ * with SSE2 (8 with word-at-a-time compares otherwise), without events.
+ * json_stream_capture() does the same but keeps the value's text, and
+ * hands it over whole once it ends, for json_doc_parse() (see json.h).
+ * Only the brackets of skipped values are checked.
+ */
+
+#ifndef LOKI_JSON_STREAM_H
+#define LOKI_JSON_STREAM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Nesting a stream follows before giving up (skipped values aside) */
+#define JSON_STREAM_MAX_DEPTH 512
+
+typedef enum {
+    JSON_EV_OBJECT_START,
+    JSON_EV_OBJECT_END,
+    JSON_EV_ARRAY_START,
+    JSON_EV_ARRAY_END,
+    JSON_EV_KEY,        /* text: the key, decoded */
+    JSON_EV_STRING,     /* text: decoded (\u escapes as UTF-8) */
+    JSON_EV_NUMBER,     /* text: as written */
+    JSON_EV_TRUE,
+    JSON_EV_FALSE,
+    JSON_EV_NULL,
+    JSON_EV_VALUE       /* text: a value given to json_stream_capture(), as written */
+} JsonEvent;
+
+typedef struct JsonStream JsonStream;
+
+/* Called for each event. 'text' is null-terminated, and only valid during
+ * the call; NULL for events without any. Return 0 to go on, or anything
+ * else to stop the stream (json_stream_feed() then returns 1). */
+typedef int (*JsonStreamFn)(void *opaque, JsonStream *s, JsonEvent ev,
+                            const char *text, size_t len);
+
+/* Create a stream reporting to 'fn'. Returns NULL on out of memory. */
+JsonStream *json_stream_new(JsonStreamFn fn, void *opaque);
+
+void json_stream_free(JsonStream *s);
+
+/* Forget any value under way (and an error, or a stop) to start again */
+void json_stream_reset(JsonStream *s);
+
+/* Parse the next 'len' bytes. Returns 0, 1 if the callback stopped the
+ * stream, or -1 if the text is not JSON (until json_stream_reset()). */
+int json_stream_feed(JsonStream *s, const char *data, size_t len);
+
+/* The input is over: a number at its very end is reported. Returns 0 if
+ * the last value was complete, or -1 inside one (or after an error). */
+int json_stream_finish(JsonStream *s);
+
+/* 1 between top-level values: nothing under way */
+int json_stream_idle(const JsonStream *s);
+
+/* Objects and arrays open around the value being reported (0 at the top;
+ * for their start and end events, around the object or array itself) */
+int json_stream_depth(const JsonStream *s);
+
+/* Whether the value being reported (or, for JSON_EV_KEY, about to be) is
+ * at 'path': keys and array indices from the top, separated by dots, as
+ * in "result.items.3.name"; "" for a top-level value. */
+int json_stream_at(const JsonStream *s, const char *path);
+
+/* From the start event of an object or array: go past it without events
+ * for its inside, or its end. */
+void json_stream_skip(JsonStream *s);
+
+/* As json_stream_skip(), but report its text with JSON_EV_VALUE once it
+ * ends. */
+void json_stream_capture(JsonStream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LOKI_JSON_STREAM_H */
@@ -1,130 +1,470 @@
 /* jsonrpc.c - JSON-RPC harness implementation
  *
  * Provides a stdio-based JSON-RPC interface for testing editor abstractions.
+ *
+ * Responses are written with a JsonBuilder, so the same code writes
+ * either format; in MessagePack the text of row segments is not copied
+ * into the response but written from the viewmodel itself with writev().
  */
 
+#define _DEFAULT_SOURCE     /* fileno(), strdup() */
+
 #include "jsonrpc.h"
 #include "json.h"
+#include "json_stream.h"
 #include "event.h"
 #include "session.h"
+#include "buffers.h"
+#include "undo.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 /* Maximum input line length */
 #define MAX_LINE 65536
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Iovecs per writev() call of a MessagePack response */
+#define RPC_IOV_BATCH (IOV_MAX < 1024 ? IOV_MAX : 1024)
+
+static JsonRpcFormat rpc_format = JSONRPC_FORMAT_JSON;
+
+void jsonrpc_set_format(JsonRpcFormat format) {
+    rpc_format = format;
+}
+
+/* A client of the harness: the session its commands go to, the frame it
+ * was sent last, and what is left over of its input */
+struct JsonRpcPeer {
+    EditorSession *session;
+    JsonRpcPeerCallbacks cb;        /* Without 'write', responses go to stdout */
+    EditorViewModel *last_vm;       /* The last frame sent, which the client may
+                                     * ask the next one as a delta of */
+    EditorViewModel *spare_vm;      /* The one before, refilled as the next */
+    int last_id;
+    int should_quit;
+    unsigned long handled;          /* Commands (or batches) run */
+    JsonStream *stream;             /* JSON input */
+    int bad_line;
+    char *in;                       /* MessagePack input: the message so far */
+    size_t in_len;
+    size_t in_cap;
+    size_t skip;                    /* Bytes left of a message too large to keep */
+};
+
+/* The client whose command is being run */
+static JsonRpcPeer *peer;
+
 /* ======================= ViewModel Serialization =========================== */
 
-char *jsonrpc_serialize_viewmodel(const EditorViewModel *vm) {
-    if (!vm) return NULL;
+static void json_cursor(JsonBuilder *jb, const EditorViewModel *vm) {
+    json_key(jb, "cursor");
+    json_object_start(jb);
+    json_kv_int(jb, "row", vm->cursor.row);
+    json_kv_int(jb, "col", vm->cursor.col);
+    json_kv_int(jb, "file_row", vm->cursor.file_row);
+    json_kv_int(jb, "file_col", vm->cursor.file_col);
+    json_kv_bool(jb, "visible", vm->cursor.visible);
+    json_object_end(jb);
+}
 
-    JsonBuilder jb;
-    json_builder_init(&jb);
+static void json_tabs(JsonBuilder *jb, const EditorViewModel *vm) {
+    json_key(jb, "tabs");
+    json_object_start(jb);
+    json_kv_int(jb, "count", vm->tabs.count);
+    json_kv_int(jb, "active", vm->tabs.active);
+    json_key(jb, "labels");
+    json_array_start(jb);
+    for (int i = 0; i < vm->tabs.count; i++) {
+        json_string(jb, vm->tabs.labels[i]);
+    }
+    json_array_end(jb);
+    json_object_end(jb);
+}
 
-    json_object_start(&jb);
+static void json_repl(JsonBuilder *jb, const EditorViewModel *vm) {
+    json_key(jb, "repl");
+    json_object_start(jb);
+    json_kv_bool(jb, "active", vm->repl_active);
+    if (vm->repl_active) {
+        json_kv_string(jb, "prompt", vm->repl.prompt);
+        json_kv_string(jb, "input", vm->repl.input);
+        json_kv_int(jb, "input_len", vm->repl.input_len);
+        json_key(jb, "log");
+        json_array_start(jb);
+        for (int i = 0; i < vm->repl.log_count; i++) {
+            json_string(jb, vm->repl.log_lines[i]);
+        }
+        json_array_end(jb);
+    }
+    json_object_end(jb);
+}
+
+/* A row view's members, inside its object */
+static void json_row(JsonBuilder *jb, const EditorRowView *rv) {
+    json_kv_int(jb, "row_num", rv->row_num);
+    json_kv_bool(jb, "is_empty", rv->is_empty);
+
+    /* Segments */
+    json_key(jb, "segments");
+    json_array_start(jb);
+    for (int j = 0; j < rv->segment_count; j++) {
+        const RenderSegment *seg = &rv->segments[j];
+        json_object_start(jb);
+        json_key(jb, "text");
+        json_string_ref(jb, seg->text, seg->len);
+        json_kv_int(jb, "hl_type", seg->hl_type);
+        json_kv_bool(jb, "selected", seg->selected);
+        json_object_end(jb);
+    }
+    json_array_end(jb);
+}
+
+/* Optional strings as JSON: null for NULL */
+static void json_kv_string_or_null(JsonBuilder *jb, const char *key, const char *value) {
+    json_key(jb, key);
+    jb->need_comma = 0;
+    if (value)
+        json_string(jb, value);
+    else
+        json_null(jb);
+}
+
+static int same_string(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void json_viewmodel(JsonBuilder *jb, const EditorViewModel *vm) {
+    json_object_start(jb);
 
     /* Screen dimensions */
-    json_kv_int(&jb, "rows", vm->rows);
-    json_kv_int(&jb, "cols", vm->cols);
-    json_kv_int(&jb, "gutter_width", vm->gutter_width);
+    json_kv_int(jb, "rows", vm->rows);
+    json_kv_int(jb, "cols", vm->cols);
+    json_kv_int(jb, "gutter_width", vm->gutter_width);
 
     /* Cursor */
-    json_key(&jb, "cursor");
-    json_object_start(&jb);
-    json_kv_int(&jb, "row", vm->cursor.row);
-    json_kv_int(&jb, "col", vm->cursor.col);
-    json_kv_int(&jb, "file_row", vm->cursor.file_row);
-    json_kv_int(&jb, "file_col", vm->cursor.file_col);
-    json_kv_bool(&jb, "visible", vm->cursor.visible);
-    json_object_end(&jb);
+    json_cursor(jb, vm);
 
     /* Status */
-    json_key(&jb, "status");
-    json_object_start(&jb);
-    json_kv_string(&jb, "mode", vm->status.mode);
-    json_kv_string(&jb, "filename", vm->status.filename);
-    json_kv_string(&jb, "lang", vm->status.lang);
-    json_kv_int(&jb, "numrows", vm->status.numrows);
-    json_kv_int(&jb, "current_row", vm->status.current_row);
-    json_kv_bool(&jb, "dirty", vm->status.dirty);
-    json_kv_bool(&jb, "playing", vm->status.playing);
-    json_kv_bool(&jb, "link_active", vm->status.link_active);
-    json_object_end(&jb);
+    json_key(jb, "status");
+    json_object_start(jb);
+    json_kv_string(jb, "mode", vm->status.mode);
+    json_kv_string(jb, "filename", vm->status.filename);
+    json_kv_string(jb, "lang", vm->status.lang);
+    json_kv_int(jb, "numrows", vm->status.numrows);
+    json_kv_int(jb, "current_row", vm->status.current_row);
+    json_kv_bool(jb, "dirty", vm->status.dirty);
+    json_kv_bool(jb, "playing", vm->status.playing);
+    json_kv_bool(jb, "link_active", vm->status.link_active);
+    json_object_end(jb);
 
     /* Message */
-    json_kv_string(&jb, "message", vm->message);
+    json_kv_string(jb, "message", vm->message);
 
     /* Tabs */
-    json_key(&jb, "tabs");
-    json_object_start(&jb);
-    json_kv_int(&jb, "count", vm->tabs.count);
-    json_kv_int(&jb, "active", vm->tabs.active);
-    json_key(&jb, "labels");
-    json_array_start(&jb);
-    for (int i = 0; i < vm->tabs.count; i++) {
-        json_string(&jb, vm->tabs.labels[i]);
-    }
-    json_array_end(&jb);
-    json_object_end(&jb);
+    json_tabs(jb, vm);
 
     /* REPL */
-    json_key(&jb, "repl");
-    json_object_start(&jb);
-    json_kv_bool(&jb, "active", vm->repl_active);
-    if (vm->repl_active) {
-        json_kv_string(&jb, "prompt", vm->repl.prompt);
-        json_kv_string(&jb, "input", vm->repl.input);
-        json_kv_int(&jb, "input_len", vm->repl.input_len);
-        json_key(&jb, "log");
-        json_array_start(&jb);
-        for (int i = 0; i < vm->repl.log_count; i++) {
-            json_string(&jb, vm->repl.log_lines[i]);
-        }
-        json_array_end(&jb);
-    }
-    json_object_end(&jb);
+    json_repl(jb, vm);
 
     /* Row views */
-    json_key(&jb, "rows_content");
-    json_array_start(&jb);
+    json_key(jb, "rows_content");
+    json_array_start(jb);
     for (int i = 0; i < vm->row_count; i++) {
-        const EditorRowView *rv = &vm->row_views[i];
-        json_object_start(&jb);
-        json_kv_int(&jb, "row_num", rv->row_num);
-        json_kv_bool(&jb, "is_empty", rv->is_empty);
-
-        /* Segments */
-        json_key(&jb, "segments");
-        json_array_start(&jb);
-        for (int j = 0; j < rv->segment_count; j++) {
-            const RenderSegment *seg = &rv->segments[j];
-            json_object_start(&jb);
-            json_key(&jb, "text");
-            json_string_len(&jb, seg->text, seg->len);
-            json_kv_int(&jb, "hl_type", seg->hl_type);
-            json_kv_bool(&jb, "selected", seg->selected);
-            json_object_end(&jb);
-        }
-        json_array_end(&jb);
+        json_object_start(jb);
+        json_row(jb, &vm->row_views[i]);
+        json_object_end(jb);
+    }
+    json_array_end(jb);
 
-        json_object_end(&jb);
+    json_object_end(jb);
+}
+
+/* About the size of 'vm' in JSON, a little over unless its text has much
+ * to escape: the room reserved for it, so that it is written in one
+ * allocation */
+static size_t viewmodel_size(const EditorViewModel *vm) {
+    size_t size = 768;      /* Dimensions, cursor, status and the keys */
+    size += vm->status.filename ? strlen(vm->status.filename) : 0;
+    size += vm->message ? strlen(vm->message) : 0;
+    size += (size_t)vm->tabs.count * 12;
+    for (int i = 0; i < vm->repl.log_count; i++)
+        size += (vm->repl.log_lines[i] ? strlen(vm->repl.log_lines[i]) : 0) + 3;
+    size += vm->repl.input ? (size_t)vm->repl.input_len : 0;
+    for (int i = 0; i < vm->row_count; i++) {
+        const EditorRowView *rv = &vm->row_views[i];
+        size += 56 + (size_t)rv->segment_count * 48;
+        for (int j = 0; j < rv->segment_count; j++)
+            size += rv->segments[j].len + rv->segments[j].len / 16;
     }
-    json_array_end(&jb);
+    return size;
+}
 
-    json_object_end(&jb);
+char *jsonrpc_serialize_viewmodel(const EditorViewModel *vm) {
+    if (!vm) return NULL;
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_builder_reserve(&jb, viewmodel_size(vm));
+    json_viewmodel(&jb, vm);
 
     /* Extract result */
-    char *result = strdup(json_builder_get(&jb));
+    char *result = json_builder_take(&jb);
+    json_builder_free(&jb);
+    return result;
+}
+
+char *jsonrpc_serialize_viewmodel_msgpack(const EditorViewModel *vm, size_t *len) {
+    if (!vm) return NULL;
+
+    JsonBuilder jb;
+    json_builder_init_msgpack(&jb);
+    json_builder_reserve(&jb, viewmodel_size(vm));
+    json_viewmodel(&jb, vm);
+    char *result = json_builder_flatten(&jb, len);
+    json_builder_free(&jb);
+    return result;
+}
+
+static int same_tabs(const EditorViewModel *a, const EditorViewModel *b) {
+    if (a->tabs.count != b->tabs.count || a->tabs.active != b->tabs.active) return 0;
+    for (int i = 0; i < a->tabs.count; i++) {
+        if (!same_string(a->tabs.labels[i], b->tabs.labels[i])) return 0;
+    }
+    return 1;
+}
+
+static int same_repl(const EditorViewModel *a, const EditorViewModel *b) {
+    if (a->repl_active != b->repl_active) return 0;
+    if (!a->repl_active) return 1;
+    if (!same_string(a->repl.prompt, b->repl.prompt) ||
+        !same_string(a->repl.input, b->repl.input) ||
+        a->repl.input_len != b->repl.input_len || a->repl.log_count != b->repl.log_count)
+        return 0;
+    for (int i = 0; i < a->repl.log_count; i++) {
+        if (!same_string(a->repl.log_lines[i], b->repl.log_lines[i])) return 0;
+    }
+    return 1;
+}
+
+/* Whether 'vm' can be sent as a delta of 'prev' */
+static int same_shape(const EditorViewModel *prev, const EditorViewModel *vm) {
+    return prev->rows == vm->rows && prev->cols == vm->cols &&
+           prev->gutter_width == vm->gutter_width && prev->row_count == vm->row_count;
+}
+
+static void json_viewmodel_delta(JsonBuilder *jb, const EditorViewModel *prev,
+                                 const EditorViewModel *vm) {
+    json_object_start(jb);
+
+    if (memcmp(&prev->cursor, &vm->cursor, sizeof(vm->cursor)) != 0) json_cursor(jb, vm);
+
+    /* Status: the fields that changed */
+    const StatusInfo *ps = &prev->status, *vs = &vm->status;
+    if (!same_string(ps->mode, vs->mode) || !same_string(ps->filename, vs->filename) ||
+        !same_string(ps->lang, vs->lang) || ps->numrows != vs->numrows ||
+        ps->current_row != vs->current_row || ps->dirty != vs->dirty ||
+        ps->playing != vs->playing || ps->link_active != vs->link_active) {
+        json_key(jb, "status");
+        json_object_start(jb);
+        if (!same_string(ps->mode, vs->mode)) json_kv_string_or_null(jb, "mode", vs->mode);
+        if (!same_string(ps->filename, vs->filename))
+            json_kv_string_or_null(jb, "filename", vs->filename);
+        if (!same_string(ps->lang, vs->lang)) json_kv_string_or_null(jb, "lang", vs->lang);
+        if (ps->numrows != vs->numrows) json_kv_int(jb, "numrows", vs->numrows);
+        if (ps->current_row != vs->current_row) json_kv_int(jb, "current_row", vs->current_row);
+        if (ps->dirty != vs->dirty) json_kv_bool(jb, "dirty", vs->dirty);
+        if (ps->playing != vs->playing) json_kv_bool(jb, "playing", vs->playing);
+        if (ps->link_active != vs->link_active) json_kv_bool(jb, "link_active", vs->link_active);
+        json_object_end(jb);
+    }
+
+    if (!same_string(prev->message, vm->message))
+        json_kv_string_or_null(jb, "message", vm->message);
+    if (!same_tabs(prev, vm)) json_tabs(jb, vm);
+    if (!same_repl(prev, vm)) json_repl(jb, vm);
+
+    /* Rows: those the snapshot rebuilt, and those it moved. A row is
+     * only reused when nothing shown in it changed (see snapshot_rows()
+     * in session.c), so unchanged rows are not compared; rows past the
+     * end of the file are never reused, but look the same. */
+    int changed = 0;
+    for (int y = 0; y < vm->row_count; y++) {
+        const EditorRowView *rv = &vm->row_views[y];
+        if (rv->prev_row == y) continue;
+        if (rv->prev_row < 0 && rv->is_empty && prev->row_views[y].is_empty) continue;
+        if (!changed++) {
+            json_key(jb, "rows_content");
+            json_array_start(jb);
+        }
+        json_object_start(jb);
+        json_kv_int(jb, "y", y);
+        if (rv->prev_row >= 0)
+            json_kv_int(jb, "from", rv->prev_row);
+        else
+            json_row(jb, rv);
+        json_object_end(jb);
+    }
+    if (changed) json_array_end(jb);
+
+    json_object_end(jb);
+}
+
+char *jsonrpc_serialize_viewmodel_delta(const EditorViewModel *prev, const EditorViewModel *vm) {
+    if (!prev || !vm || !same_shape(prev, vm)) return NULL;
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_viewmodel_delta(&jb, prev, vm);
+
+    char *result = jb.error ? NULL : strdup(json_builder_get(&jb));
     json_builder_free(&jb);
     return result;
 }
 
 /* ======================= Response Helpers ================================== */
 
-static void respond_ok(void) {
-    printf("{\"ok\":true}\n");
+static void response_init(JsonBuilder *jb) {
+    if (rpc_format == JSONRPC_FORMAT_MSGPACK)
+        json_builder_init_msgpack(jb);
+    else
+        json_builder_init(jb);
+}
+
+/* writev() the whole iovec array, resuming after short writes. */
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt < RPC_IOV_BATCH ? cnt : RPC_IOV_BATCH);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/* A MessagePack response: its size as 4 bytes, big-endian, then the
+ * value, pieces kept by reference included */
+static void send_msgpack(JsonBuilder *jb) {
+    static const char empty_map = (char)0x80;
+    size_t size = jb->error ? 1 : json_builder_size(jb);
+    unsigned char head[4] = {
+        (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+        (unsigned char)(size >> 8), (unsigned char)size
+    };
+    struct iovec one[2];
+    struct iovec *iov = one;
+    int n = 2;
+    one[1].iov_base = (void *)&empty_map;
+    one[1].iov_len = 1;
+    if (!jb->error) {
+        n = json_builder_iov(jb, NULL, 0) + 1;
+        if (n > 2) {
+            iov = malloc((size_t)n * sizeof(*iov));
+            if (!iov) {
+                perror("Out of memory");
+                exit(1);
+            }
+        }
+        json_builder_iov(jb, iov + 1, n - 1);
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+
     fflush(stdout);
+    writev_all(fileno(stdout), iov, n);
+    if (iov != one) free(iov);
+}
+
+/* Commands run in a batch: their responses are not sent, and the first
+ * error is kept for the batch's own */
+static struct {
+    int active;
+    int failed;
+    char error[256];
+} batch;
+
+/* Set while a command with "render" runs: its ok is the frame after it */
+static struct {
+    EditorSession *session;
+    int since;
+} render_after;
+
+static void respond_frame(EditorSession *session, int since, int done);
+
+/* A response to a client with its own 'write': copied out, size first in
+ * MessagePack, with a newline in JSON */
+static void send_to_peer(JsonBuilder *jb) {
+    size_t len = jb->len;
+    char *data = jb->buf;
+    if (jb->error || jb->ref_count > 0 || !data)
+        data = json_builder_flatten(jb, &len);
+    if (!data) {
+        data = strdup(rpc_format == JSONRPC_FORMAT_MSGPACK ? "\x80" : "{}");
+        if (!data) {
+            perror("Out of memory");
+            exit(1);
+        }
+        len = 1 + (rpc_format != JSONRPC_FORMAT_MSGPACK);
+    }
+    if (rpc_format == JSONRPC_FORMAT_MSGPACK) {
+        char head[4] = {
+            (char)(len >> 24), (char)(len >> 16), (char)(len >> 8), (char)len
+        };
+        peer->cb.write(peer->cb.opaque, head, sizeof(head));
+        peer->cb.write(peer->cb.opaque, data, len);
+    } else {
+        peer->cb.write(peer->cb.opaque, data, len);
+        peer->cb.write(peer->cb.opaque, "\n", 1);
+    }
+    if (data != jb->buf) free(data);
+}
+
+/* Write the response in 'jb' and free it */
+static void send_response(JsonBuilder *jb) {
+    if (batch.active) {
+        json_builder_free(jb);
+        return;
+    }
+    if (peer && peer->cb.write) {
+        send_to_peer(jb);
+    } else if (rpc_format == JSONRPC_FORMAT_MSGPACK) {
+        send_msgpack(jb);
+    } else {
+        printf("%s\n", json_builder_get(jb));
+        fflush(stdout);
+    }
+    json_builder_free(jb);
+}
+
+static void respond_ok(void) {
+    if (batch.active) return;
+    if (render_after.session) {
+        respond_frame(render_after.session, render_after.since, -1);
+        return;
+    }
+    JsonBuilder jb;
+    response_init(&jb);
+    json_object_start(&jb);
+    json_kv_bool(&jb, "ok", 1);
+    json_object_end(&jb);
+    send_response(&jb);
 }
 
 static void respond_ok_with(const char *extra_json) {
@@ -133,31 +473,93 @@ static void respond_ok_with(const char *extra_json) {
 }
 
 static void respond_error(const char *msg) {
+    if (batch.active) {
+        if (!batch.failed) snprintf(batch.error, sizeof(batch.error), "%s", msg);
+        batch.failed = 1;
+        return;
+    }
     JsonBuilder jb;
-    json_builder_init(&jb);
+    response_init(&jb);
     json_object_start(&jb);
     json_kv_bool(&jb, "ok", 0);
     json_kv_string(&jb, "error", msg);
     json_object_end(&jb);
-    printf("%s\n", json_builder_get(&jb));
-    json_builder_free(&jb);
-    fflush(stdout);
+    send_response(&jb);
 }
 
-static void respond_viewmodel(const EditorViewModel *vm) {
-    char *vm_json = jsonrpc_serialize_viewmodel(vm);
-    if (vm_json) {
-        printf("{\"ok\":true,\"viewmodel\":%s}\n", vm_json);
-        free(vm_json);
+/* The frame is kept as the spare, for its memory */
+static void forget_last_frame(JsonRpcPeer *p) {
+    if (!p->spare_vm) {
+        p->spare_vm = p->last_vm;
     } else {
+        editor_viewmodel_free(p->last_vm);
+    }
+    p->last_vm = NULL;
+}
+
+/* Send 'vm' (which is taken) as the next frame: as a delta of the last
+ * one if the client has it ('since' is its id), whole otherwise. The
+ * response may refer to the text of 'vm', kept as the last frame. With
+ * 'done' >= 0, it answers for a batch of that many commands. */
+static void respond_viewmodel(EditorViewModel *vm, int since, int done) {
+    const EditorViewModel *base = NULL;
+    if (since >= 0 && peer->last_vm && since == peer->last_id && same_shape(peer->last_vm, vm))
+        base = peer->last_vm;
+    peer->last_id = peer->last_id == INT_MAX ? 1 : peer->last_id + 1;
+
+    JsonBuilder jb;
+    response_init(&jb);
+    if (!base) json_builder_reserve(&jb, viewmodel_size(vm) + 64);
+    json_object_start(&jb);
+    json_kv_bool(&jb, "ok", 1);
+    if (done >= 0) json_kv_int(&jb, "done", done);
+    json_kv_int(&jb, "frame", peer->last_id);
+    if (base) {
+        json_kv_int(&jb, "base", since);
+        json_key(&jb, "delta");
+        json_viewmodel_delta(&jb, base, vm);
+    } else {
+        json_key(&jb, "viewmodel");
+        json_viewmodel(&jb, vm);
+    }
+    json_object_end(&jb);
+
+    if (jb.error) {
+        json_builder_free(&jb);
         respond_error("Failed to serialize viewmodel");
+    } else {
+        send_response(&jb);
     }
-    fflush(stdout);
+    forget_last_frame(peer);
+    peer->last_vm = vm;
+}
+
+static void respond_frame(EditorSession *session, int since, int done) {
+    /* Frames are filled into the two the client was last sent in turn,
+     * so none is allocated once they have grown to size */
+    EditorViewModel *vm = peer->spare_vm;
+    peer->spare_vm = NULL;
+    if (!vm) {
+        vm = editor_session_snapshot(session);
+    } else if (editor_session_snapshot_into(session, vm) < 0) {
+        editor_viewmodel_free(vm);
+        vm = NULL;
+    }
+    if (vm) {
+        respond_viewmodel(vm, since, done);
+    } else {
+        respond_error("Failed to create snapshot");
+    }
+}
+
+/* Byte counts as JSON ints */
+static int clamp_int(size_t n) {
+    return n > INT_MAX ? INT_MAX : (int)n;
 }
 
 static void respond_status(EditorSession *session) {
     JsonBuilder jb;
-    json_builder_init(&jb);
+    response_init(&jb);
     json_object_start(&jb);
     json_kv_bool(&jb, "ok", 1);
     json_kv_string(&jb, "mode",
@@ -167,10 +569,63 @@ static void respond_status(EditorSession *session) {
         editor_session_get_mode(session) == MODE_COMMAND ? "command" : "unknown");
     json_kv_string(&jb, "filename", editor_session_get_filename(session));
     json_kv_bool(&jb, "dirty", editor_session_is_dirty(session));
+    editor_ctx_t *ctx = editor_session_get_ctx(session);
+    if (ctx) {
+        EditorCounts n = editor_model_counts(&ctx->model);
+        json_kv_int(&jb, "lines", n.lines);
+        json_kv_int(&jb, "words", clamp_int((size_t)n.words));
+        json_kv_int(&jb, "bytes", clamp_int((size_t)n.bytes));
+    }
     json_object_end(&jb);
-    printf("%s\n", json_builder_get(&jb));
-    json_builder_free(&jb);
-    fflush(stdout);
+    send_response(&jb);
+}
+
+/* The undo history statistics of one buffer, as an object */
+static void json_undo_stats(JsonBuilder *jb, editor_ctx_t *ctx, int id,
+                            const char *name) {
+    undo_memory_stats_t st;
+    int undo_levels, redo_levels;
+    undo_get_memory_stats(ctx, &st);
+    undo_get_stats(ctx, &undo_levels, &redo_levels, NULL);
+
+    json_object_start(jb);
+    json_kv_int(jb, "id", id);
+    json_kv_string(jb, "name", name ? name : "[No Name]");
+    json_kv_int(jb, "bytes", clamp_int(st.total));
+    json_kv_int(jb, "limit", clamp_int(st.limit));
+    json_kv_int(jb, "text_bytes", clamp_int(st.text));
+    json_kv_int(jb, "shared_bytes", clamp_int(st.shared));
+    json_kv_int(jb, "packed_bytes", clamp_int(st.packed));
+    json_kv_int(jb, "groups", st.groups);
+    json_kv_int(jb, "packed_groups", st.packed_groups);
+    json_kv_int(jb, "entries", st.entries);
+    json_kv_int(jb, "undo_levels", undo_levels);
+    json_kv_int(jb, "redo_levels", redo_levels);
+    json_object_end(jb);
+}
+
+/* Undo statistics of every open buffer, or of the session's own buffer
+ * when the buffer list is not in use */
+static void respond_undo_stats(EditorSession *session) {
+    JsonBuilder jb;
+    response_init(&jb);
+    json_object_start(&jb);
+    json_kv_bool(&jb, "ok", 1);
+    json_key(&jb, "buffers");
+    json_array_start(&jb);
+    int n = buffer_count();
+    for (int i = 0; i < n; i++) {
+        int id = buffer_get_id_at(i);
+        editor_ctx_t *ctx = buffer_get(id);
+        if (ctx) json_undo_stats(&jb, ctx, id, buffer_get_display_name(id));
+    }
+    if (n == 0) {
+        editor_ctx_t *ctx = editor_session_get_ctx(session);
+        if (ctx) json_undo_stats(&jb, ctx, 0, editor_session_get_filename(session));
+    }
+    json_array_end(&jb);
+    json_object_end(&jb);
+    send_response(&jb);
 }
 
 /* ======================= Command Processing ================================ */
@@ -184,7 +639,10 @@ typedef enum {
     CMD_STATUS,
     CMD_QUIT,
     CMD_RESIZE,
-    CMD_INSERT_TEXT
+    CMD_INSERT_TEXT,
+    CMD_UNDO_STATS,
+    CMD_BATCH,
+    CMD_ATTACH
 } CommandType;
 
 static CommandType parse_command_type(const char *cmd) {
@@ -197,11 +655,57 @@ static CommandType parse_command_type(const char *cmd) {
     if (strcmp(cmd, "quit") == 0) return CMD_QUIT;
     if (strcmp(cmd, "resize") == 0) return CMD_RESIZE;
     if (strcmp(cmd, "insert") == 0) return CMD_INSERT_TEXT;
+    if (strcmp(cmd, "undo_stats") == 0) return CMD_UNDO_STATS;
+    if (strcmp(cmd, "batch") == 0) return CMD_BATCH;
+    if (strcmp(cmd, "attach") == 0) return CMD_ATTACH;
     return CMD_UNKNOWN;
 }
 
-/* Process a single command. Returns 1 if should quit, 0 to continue. */
-static int process_command(EditorSession *session, const JsonValue *cmd_obj) {
+static int process_command(EditorSession *session, const JsonValue *cmd_obj);
+
+/* Run the commands of a batch in order, stopping at the first that fails
+ * or quits, and answer for them all at once: with the frame after them
+ * if 'render', and how many were done. Returns 1 if should quit. */
+static int run_batch(EditorSession *session, const JsonValue *cmds, int since, int render) {
+    if (batch.active) {
+        respond_error("batch: batches do not nest");
+        return 0;
+    }
+    batch.active = 1;
+    batch.failed = 0;
+    int done = 0, quit = 0;
+    for (size_t i = 0; i < cmds->data.array_val.count && !quit; i++) {
+        quit = process_command(session, &cmds->data.array_val.items[i]);
+        if (batch.failed) break;
+        done++;
+    }
+    batch.active = 0;
+
+    if (batch.failed) {
+        JsonBuilder jb;
+        response_init(&jb);
+        json_object_start(&jb);
+        json_kv_bool(&jb, "ok", 0);
+        json_kv_string(&jb, "error", batch.error);
+        json_kv_int(&jb, "done", done);
+        json_object_end(&jb);
+        send_response(&jb);
+    } else if (render) {
+        respond_frame(session, since, done);
+    } else {
+        JsonBuilder jb;
+        response_init(&jb);
+        json_object_start(&jb);
+        json_kv_bool(&jb, "ok", 1);
+        json_kv_int(&jb, "done", done);
+        json_object_end(&jb);
+        send_response(&jb);
+    }
+    return quit;
+}
+
+/* Run a single command. Returns 1 if should quit, 0 to continue. */
+static int run_command(EditorSession *session, const JsonValue *cmd_obj) {
     if (cmd_obj->type != JSON_OBJECT) {
         respond_error("Expected JSON object");
         return 0;
@@ -272,16 +776,11 @@ static int process_command(EditorSession *session, const JsonValue *cmd_obj) {
             return 0;
         }
 
-        case CMD_SNAPSHOT: {
-            EditorViewModel *vm = editor_session_snapshot(session);
-            if (vm) {
-                respond_viewmodel(vm);
-                editor_viewmodel_free(vm);
-            } else {
-                respond_error("Failed to create snapshot");
-            }
+        case CMD_SNAPSHOT:
+            /* A batch sends its frame once, at its end */
+            if (!batch.active)
+                respond_frame(session, json_object_get_int(cmd_obj, "since", -1), -1);
             return 0;
-        }
 
         case CMD_STATUS: {
             respond_status(session);
@@ -313,6 +812,39 @@ static int process_command(EditorSession *session, const JsonValue *cmd_obj) {
             return 0;
         }
 
+        case CMD_UNDO_STATS:
+            respond_undo_stats(session);
+            return 0;
+
+        case CMD_BATCH: {
+            const JsonValue *cmds = json_object_get(cmd_obj, "commands");
+            if (!cmds || cmds->type != JSON_ARRAY) {
+                respond_error("batch: missing 'commands' array");
+                return 0;
+            }
+            return run_batch(session, cmds, json_object_get_int(cmd_obj, "since", -1),
+                             json_object_get_bool(cmd_obj, "render", 1));
+        }
+
+        case CMD_ATTACH: {
+            const char *name = json_object_get_string(cmd_obj, "session");
+            EditorSession *to;
+            if (!name) {
+                respond_error("attach: missing 'session' parameter");
+            } else if (batch.active) {
+                respond_error("attach: not in a batch");
+            } else if (!peer->cb.attach || !(to = peer->cb.attach(peer->cb.opaque, name))) {
+                respond_error("attach: no such session");
+            } else {
+                /* The session the command came with may be gone */
+                peer->session = to;
+                if (render_after.session) render_after.session = to;
+                forget_last_frame(peer);
+                respond_ok();
+            }
+            return 0;
+        }
+
         case CMD_QUIT:
             respond_ok();
             return 1;
@@ -324,9 +856,253 @@ static int process_command(EditorSession *session, const JsonValue *cmd_obj) {
     }
 }
 
+/* Process a command, or an array of them as a batch. Returns 1 if should
+ * quit, 0 to continue. */
+static int process_command(EditorSession *session, const JsonValue *cmd_obj) {
+    int quit;
+    if (cmd_obj->type == JSON_ARRAY) {
+        quit = run_batch(session, cmd_obj, -1, 1);
+    } else {
+        int render = !batch.active && json_object_get_bool(cmd_obj, "render", 0);
+        if (render) {
+            render_after.session = session;
+            render_after.since = json_object_get_int(cmd_obj, "since", -1);
+        }
+        quit = run_command(session, cmd_obj);
+        render_after.session = NULL;
+    }
+
+    /* Whatever may have changed what the session shows */
+    if (!batch.active && peer->cb.changed) {
+        CommandType type = cmd_obj->type == JSON_ARRAY ? CMD_BATCH :
+                           parse_command_type(json_object_get_string(cmd_obj, "cmd"));
+        if (type == CMD_LOAD || type == CMD_EVENT || type == CMD_RESIZE ||
+            type == CMD_INSERT_TEXT || type == CMD_BATCH)
+            peer->cb.changed(peer->cb.opaque, peer->session);
+    }
+    return quit;
+}
+
+/* ======================= Peers ============================================= */
+
+/* Commands of a JSON peer, as its stream finds them */
+static int on_stream_event(void *opaque, JsonStream *s, JsonEvent ev,
+                           const char *text, size_t len) {
+    JsonRpcPeer *p = opaque;
+    if (json_stream_depth(s) > 0) return 0;
+    switch (ev) {
+        case JSON_EV_OBJECT_START:
+        case JSON_EV_ARRAY_START:
+            json_stream_capture(s);
+            return 0;
+        case JSON_EV_VALUE: {
+            JsonDoc cmd;
+            if (json_doc_parse(&cmd, text, len) != 0) {
+                respond_error("Invalid JSON");
+            } else {
+                p->should_quit = process_command(p->session, &cmd.root);
+                p->handled++;
+            }
+            json_doc_free(&cmd);
+            return p->should_quit;
+        }
+        default:
+            respond_error("Expected JSON object");
+            return 0;
+    }
+}
+
+JsonRpcPeer *jsonrpc_peer_new(EditorSession *session, const JsonRpcPeerCallbacks *cb) {
+    JsonRpcPeer *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->session = session;
+    if (cb) p->cb = *cb;
+    if (rpc_format == JSONRPC_FORMAT_JSON) {
+        p->stream = json_stream_new(on_stream_event, p);
+        if (!p->stream) {
+            free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+void jsonrpc_peer_free(JsonRpcPeer *p) {
+    if (!p) return;
+    forget_last_frame(p);
+    editor_viewmodel_free(p->spare_vm);
+    json_stream_free(p->stream);
+    free(p->in);
+    free(p);
+}
+
+EditorSession *jsonrpc_peer_session(const JsonRpcPeer *p) {
+    return p->session;
+}
+
+/* One command a line: a line that is not JSON is answered once, and the
+ * stream starts again after it. A command may be cut anywhere. */
+static void feed_json(JsonRpcPeer *p, const char *data, size_t len) {
+    while (len > 0 && !p->should_quit) {
+        const char *nl = memchr(data, '\n', len);
+        size_t n = nl ? (size_t)(nl - data) + 1 : len;
+
+        if (!p->bad_line && json_stream_feed(p->stream, data, n) < 0) {
+            respond_error("Invalid JSON");
+            p->bad_line = 1;
+        }
+        if (nl) {
+            if (!p->bad_line && !p->should_quit && !json_stream_idle(p->stream))
+                respond_error("Invalid JSON");
+            json_stream_reset(p->stream);
+            p->bad_line = 0;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* Messages of a 4-byte big-endian size and that many bytes, gathered in
+ * p->in (grown as needed). A message that does not fit in memory is
+ * answered with an error and skipped. */
+static void feed_msgpack(JsonRpcPeer *p, const char *data, size_t len) {
+    while (len > 0 && !p->should_quit) {
+        if (p->skip) {
+            size_t n = len < p->skip ? len : p->skip;
+            p->skip -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        int sized = p->in_len >= 4;
+        size_t need = 4;
+        if (sized) {
+            const unsigned char *h = (const unsigned char *)p->in;
+            need += (size_t)h[0] << 24 | (size_t)h[1] << 16 | (size_t)h[2] << 8 | h[3];
+        }
+        if (need > p->in_cap) {
+            size_t cap = p->in_cap ? p->in_cap : 256;
+            while (cap < need) cap *= 2;
+            char *grown = realloc(p->in, cap);
+            if (!grown) {
+                respond_error("Message too large");
+                p->skip = need - p->in_len;
+                p->in_len = 0;
+                continue;
+            }
+            p->in = grown;
+            p->in_cap = cap;
+        }
+
+        size_t n = need - p->in_len;
+        if (n > len) n = len;
+        memcpy(p->in + p->in_len, data, n);
+        p->in_len += n;
+        data += n;
+        len -= n;
+        if (!sized || p->in_len < need) continue;
+
+        JsonDoc cmd;
+        p->in_len = 0;
+        if (json_doc_parse_msgpack(&cmd, p->in + 4, need - 4) != 0) {
+            respond_error("Invalid MessagePack");
+        } else {
+            p->should_quit = process_command(p->session, &cmd.root);
+            p->handled++;
+        }
+        json_doc_free(&cmd);
+    }
+}
+
+int jsonrpc_peer_feed(JsonRpcPeer *p, const char *data, size_t len) {
+    JsonRpcPeer *outer = peer;
+    peer = p;
+    if (p->stream)
+        feed_json(p, data, len);
+    else
+        feed_msgpack(p, data, len);
+    peer = outer;
+    return p->should_quit;
+}
+
+int jsonrpc_peer_finish(JsonRpcPeer *p) {
+    if (p->should_quit) return 0;
+    JsonRpcPeer *outer = peer;
+    peer = p;
+    int rc = 0;
+    if (p->stream) {
+        if (!p->bad_line && json_stream_finish(p->stream) != 0) {
+            respond_error("Invalid JSON");
+            rc = -1;
+        }
+    } else if (p->in_len > 0 || p->skip > 0) {
+        respond_error("Truncated message");
+        rc = -1;
+    }
+    peer = outer;
+    return rc;
+}
+
+void jsonrpc_peer_notify(JsonRpcPeer *p, const char *event, const char *session_name) {
+    JsonRpcPeer *outer = peer;
+    peer = p;
+    JsonBuilder jb;
+    response_init(&jb);
+    json_object_start(&jb);
+    json_kv_string(&jb, "event", event);
+    json_kv_string_or_null(&jb, "session", session_name);
+    json_object_end(&jb);
+    send_response(&jb);
+    peer = outer;
+}
+
 /* ======================= Main Entry Points ================================= */
 
+/* Feed the peer stdin as it comes, until quit or its end. Returns 1 if
+ * no command was read whole. */
+static int run_stdin(JsonRpcPeer *p, int single) {
+    if (rpc_format == JSONRPC_FORMAT_JSON) {
+        /* Lines are read in pieces of MAX_LINE at most, so a command
+         * may be as long as it likes; each still ends with its line. */
+        char line[MAX_LINE];
+        while (!(single && p->handled) && fgets(line, sizeof(line), stdin)) {
+            if (jsonrpc_peer_feed(p, line, strlen(line))) break;
+        }
+    } else {
+        char buf[MAX_LINE];
+        while (!(single && p->handled)) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            if (jsonrpc_peer_feed(p, buf, (size_t)n)) break;
+        }
+    }
+    if (!(single && p->handled) && jsonrpc_peer_finish(p) != 0) return 1;
+    if (single && !p->handled) {
+        JsonRpcPeer *outer = peer;
+        peer = p;
+        respond_error("No input");
+        peer = outer;
+    }
+    return !p->handled;
+}
+
 int jsonrpc_run_single(const EditorConfig *config) {
+    if (rpc_format == JSONRPC_FORMAT_MSGPACK) {
+        EditorSession *session = editor_session_new(config);
+        JsonRpcPeer *p = session ? jsonrpc_peer_new(session, NULL) : NULL;
+        if (!p) {
+            editor_session_free(session);
+            respond_error("Failed to create session");
+            return 1;
+        }
+        int rc = run_stdin(p, 1);
+        jsonrpc_peer_free(p);
+        editor_session_free(session);
+        return rc;
+    }
+
     /* Read single line from stdin */
     char line[MAX_LINE];
     if (!fgets(line, sizeof(line), stdin)) {
@@ -341,25 +1117,31 @@ int jsonrpc_run_single(const EditorConfig *config) {
     }
 
     /* Parse JSON */
-    JsonValue cmd = json_parse(line);
-    if (cmd.type == JSON_ERROR) {
+    JsonDoc cmd;
+    if (json_doc_parse_insitu(&cmd, line, strlen(line)) != 0) {
+        json_doc_free(&cmd);
         respond_error("Invalid JSON");
         return 1;
     }
 
     /* Create session */
     EditorSession *session = editor_session_new(config);
-    if (!session) {
-        json_value_free(&cmd);
+    JsonRpcPeer *p = session ? jsonrpc_peer_new(session, NULL) : NULL;
+    if (!p) {
+        editor_session_free(session);
+        json_doc_free(&cmd);
         respond_error("Failed to create session");
         return 1;
     }
 
     /* Process command */
-    process_command(session, &cmd);
+    peer = p;
+    process_command(session, &cmd.root);
+    peer = NULL;
 
     /* Cleanup */
-    json_value_free(&cmd);
+    json_doc_free(&cmd);
+    jsonrpc_peer_free(p);
     editor_session_free(session);
 
     return 0;
@@ -368,40 +1150,18 @@ int jsonrpc_run_single(const EditorConfig *config) {
 int jsonrpc_run_interactive(const EditorConfig *config) {
     /* Create session */
     EditorSession *session = editor_session_new(config);
-    if (!session) {
+    JsonRpcPeer *p = session ? jsonrpc_peer_new(session, NULL) : NULL;
+    if (!p) {
+        editor_session_free(session);
         respond_error("Failed to create session");
         return 1;
     }
 
     /* Read and process commands until quit or EOF */
-    char line[MAX_LINE];
-    int should_quit = 0;
-
-    while (!should_quit && fgets(line, sizeof(line), stdin)) {
-        /* Remove trailing newline */
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
-
-        /* Skip empty lines */
-        if (len == 0 || (len == 1 && line[0] == '\0')) {
-            continue;
-        }
-
-        /* Parse JSON */
-        JsonValue cmd = json_parse(line);
-        if (cmd.type == JSON_ERROR) {
-            respond_error("Invalid JSON");
-            continue;
-        }
-
-        /* Process command */
-        should_quit = process_command(session, &cmd);
-        json_value_free(&cmd);
-    }
+    run_stdin(p, 0);
 
     /* Cleanup */
+    jsonrpc_peer_free(p);
     editor_session_free(session);
 
     return 0;
@@ -9,12 +9,42 @@
  *   {"cmd": "event", "type": "key", "code": 105}
  *   {"cmd": "event", "type": "key", "code": 27, "modifiers": 1}  // Ctrl
  *   {"cmd": "snapshot"}
- *   {"cmd": "status"}
+ *   {"cmd": "snapshot", "since": 41}      // A delta of frame 41
+ *   {"cmd": "status"}                    // Mode, file, lines/words/bytes
+ *   {"cmd": "undo_stats"}
+ *   {"cmd": "batch", "commands": [{...}, ...], "since": 41}
  *   {"cmd": "quit"}
  *
  * Responses:
  *   {"ok": true, ...}
  *   {"ok": false, "error": "message"}
+ *
+ * Snapshots are numbered frames: {"ok": true, "frame": 42, "viewmodel":
+ * {...}}. A client that has the last frame sent passes its number as
+ * "since" and gets {"ok": true, "frame": 42, "base": 41, "delta": {...}}
+ * instead, or the whole viewmodel if it has another. A delta holds the
+ * members of the viewmodel that changed: "cursor", "tabs" and "repl"
+ * whole; "status" with only its changed fields; "message" (null when
+ * cleared); and "rows_content" with only the screen rows that changed,
+ * each with its "y", and "from": the row of the base frame it repeats,
+ * for rows that only moved, or its content. Frames of different
+ * dimensions are sent whole.
+ *
+ * Commands render nothing unless they ask: any command given "render":
+ * true (and "since", as for a snapshot) answers its ok with the frame
+ * after it. A batch runs its commands in order, without their responses,
+ * and answers once, with "done": the number run, and the frame after the
+ * last unless it has "render": false. A bare array of commands is a
+ * batch too. A batch stops at the first command that fails, answering
+ * {"ok": false, "error": ..., "done": N} with no frame; a snapshot in a
+ * batch does nothing. Bursts of keys (a paste, a macro) are then one
+ * message and one frame.
+ *
+ * With JSONRPC_FORMAT_MSGPACK (--rpc-format=msgpack) the same commands
+ * and responses are MessagePack maps instead, each message (both ways)
+ * preceded by its size in bytes, 4 of them, big-endian. Messages have
+ * no size limit but memory, and the text of viewmodel rows is written
+ * from the snapshot as it is, not copied into the response.
  */
 
 #ifndef LOKI_JSONRPC_H
@@ -26,6 +56,18 @@
 extern "C" {
 #endif
 
+typedef enum {
+    JSONRPC_FORMAT_JSON,        /* Lines of JSON (the default) */
+    JSONRPC_FORMAT_MSGPACK      /* Size-prefixed MessagePack */
+} JsonRpcFormat;
+
+/**
+ * Choose the format of the commands and responses of the run functions.
+ *
+ * @param format  JSONRPC_FORMAT_JSON or JSONRPC_FORMAT_MSGPACK
+ */
+void jsonrpc_set_format(JsonRpcFormat format);
+
 /**
  * Run the JSON-RPC harness in single-shot mode.
  *
@@ -49,6 +91,64 @@ int jsonrpc_run_single(const EditorConfig *config);
  */
 int jsonrpc_run_interactive(const EditorConfig *config);
 
+/**
+ * JsonRpcPeer - One client of the harness, for hosts that serve several
+ * (see rpc_server.h): the session its commands go to, the frame it was
+ * sent last, and its input so far.
+ */
+typedef struct JsonRpcPeer JsonRpcPeer;
+
+typedef struct {
+    /* Send 'len' bytes of responses to the client (NULL: to stdout) */
+    void (*write)(void *opaque, const char *data, size_t len);
+
+    /* {"cmd": "attach", "session": name}: the session the client's
+     * commands go to from now on, or NULL to refuse */
+    EditorSession *(*attach)(void *opaque, const char *name);
+
+    /* A command of the client may have changed what its session shows */
+    void (*changed)(void *opaque, EditorSession *session);
+
+    void *opaque;
+} JsonRpcPeerCallbacks;
+
+/**
+ * Create a client of 'session', in the format set by jsonrpc_set_format().
+ *
+ * @param session  Session its commands go to
+ * @param cb       Callbacks (copied), or NULL
+ * @return The peer, or NULL on out of memory
+ */
+JsonRpcPeer *jsonrpc_peer_new(EditorSession *session, const JsonRpcPeerCallbacks *cb);
+
+void jsonrpc_peer_free(JsonRpcPeer *peer);
+
+/**
+ * Run the commands in the next 'len' bytes of the client's input, which
+ * may end anywhere, writing their responses.
+ *
+ * @return 1 once the client has quit (the rest is ignored), 0 otherwise
+ */
+int jsonrpc_peer_feed(JsonRpcPeer *peer, const char *data, size_t len);
+
+/**
+ * The client's input is over: answer a command it left unfinished.
+ *
+ * @return 0, or -1 if a command was left unfinished
+ */
+int jsonrpc_peer_finish(JsonRpcPeer *peer);
+
+/* The session the peer's commands go to (it may have attached another) */
+EditorSession *jsonrpc_peer_session(const JsonRpcPeer *peer);
+
+/**
+ * Send the peer a notification: {"event": event, "session": name}.
+ *
+ * @param event         What happened, e.g. "changed"
+ * @param session_name  The session it happened to, or NULL
+ */
+void jsonrpc_peer_notify(JsonRpcPeer *peer, const char *event, const char *session_name);
+
 /**
  * Serialize an EditorViewModel to JSON.
  *
@@ -57,6 +157,26 @@ int jsonrpc_run_interactive(const EditorConfig *config);
  */
 char *jsonrpc_serialize_viewmodel(const EditorViewModel *vm);
 
+/**
+ * Serialize an EditorViewModel to MessagePack, as in a snapshot response.
+ *
+ * @param vm   View model to serialize
+ * @param len  Output: bytes of the result
+ * @return MessagePack data (caller must free), or NULL on error
+ */
+char *jsonrpc_serialize_viewmodel_msgpack(const EditorViewModel *vm, size_t *len);
+
+/**
+ * Serialize what changed from the viewmodel 'prev' to 'vm', the next
+ * snapshot of the same session (see the delta format above).
+ *
+ * @param prev  The previous snapshot
+ * @param vm    View model to serialize
+ * @return JSON string (caller must free), or NULL if 'vm' must be sent
+ *         whole (its dimensions changed) or on error
+ */
+char *jsonrpc_serialize_viewmodel_delta(const EditorViewModel *prev, const EditorViewModel *vm);
+
 #ifdef __cplusplus
 }
 #endif
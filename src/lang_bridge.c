@@ -2,19 +2,91 @@
  *
  * Manages language registration and provides dispatch functions
  * for core editor code to interact with languages without direct coupling.
+ *
+ * Evaluations with eval_async() are jobs in a list kept on the UI thread,
+ * each with a thread of its own; the worker only reads its copy of the
+ * code and writes its result, and its events carry no more than the job's
+ * id, which the handler looks up (a job finished or forgotten meanwhile
+ * is not found, and its events are ignored).
  */
 
+#define _DEFAULT_SOURCE     /* nanosleep(), strdup() */
+
 #include "lang_bridge.h"
 #include "internal.h"  /* For editor_ctx_t full definition */
+#include "languages.h"
+#include "startup.h"
+#include "shared/context.h"
+#ifdef LOKI_USE_LINENOISE
+#include "treesitter.h"
+#endif
+#include <uv.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
 
 /* ======================= Internal State ======================= */
 
 static const LokiLangOps *g_languages[LOKI_MAX_LANGUAGES];
 static int g_language_count = 0;
+static unsigned long g_generation = 1;
+
+/* Languages with callbacks_signalled that said they have callbacks */
+static atomic_int g_callbacks_pending[LOKI_MAX_LANGUAGES];
+
+enum { LANG_EVENT_PROGRESS, LANG_EVENT_DONE, LANG_EVENT_CALLBACKS };
+
+struct LokiLangEvalJob {
+    int id;
+    editor_ctx_t *ctx;
+    const LokiLangOps *ops;
+    char *code;                 /* The copy evaluated */
+    uv_thread_t thread;
+    int threaded;               /* Runs on 'thread', not the caller's */
+    atomic_int cancelled;
+    atomic_int joining;         /* finish_job() waits: no event needed */
+    int result;                 /* eval_async()'s, once it returned */
+    char error[LOKI_LANG_ERROR_SIZE];
+    struct LokiLangEvalJob *next;
+};
+
+static LokiLangEvalJob *g_jobs = NULL;
+static int g_next_job_id = 1;
+
+/* Error of the last evaluation through eval_async() that failed */
+static char g_eval_error[LOKI_LANG_ERROR_SIZE];
+
+/* Extension -> language, open addressing. Twice the most extensions that
+ * can be registered, so probes stay short; a power of two. */
+#define LANG_EXT_SLOTS 64
+
+static struct {
+    const char *ext;
+    const LokiLangOps *ops;
+} g_by_ext[LANG_EXT_SLOTS];
+
+static unsigned int ext_hash(const char *ext) {
+    unsigned int h = 2166136261u;     /* FNV-1a */
+    while (*ext) {
+        h ^= (unsigned char)*ext++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* The first language registered for an extension keeps it */
+static void index_extension(const char *ext, const LokiLangOps *ops) {
+    unsigned int i = ext_hash(ext) & (LANG_EXT_SLOTS - 1);
+    while (g_by_ext[i].ext) {
+        if (strcmp(g_by_ext[i].ext, ext) == 0) return;
+        i = (i + 1) & (LANG_EXT_SLOTS - 1);
+    }
+    g_by_ext[i].ext = ext;
+    g_by_ext[i].ops = ops;
+}
 
 /* ======================= Registration ======================= */
 
@@ -37,9 +109,20 @@ int loki_lang_register(const LokiLangOps *ops) {
     }
 
     g_languages[g_language_count++] = ops;
+    for (int j = 0; j < LOKI_MAX_EXTENSIONS && ops->extensions[j]; j++)
+        index_extension(ops->extensions[j], ops);
+    loki_lang_registry_changed();
     return 0;
 }
 
+unsigned long loki_lang_generation(void) {
+    return g_generation;
+}
+
+void loki_lang_registry_changed(void) {
+    if (++g_generation == 0) g_generation = 1;
+}
+
 /* ======================= Dispatch ======================= */
 
 static const char *get_extension(const char *filename) {
@@ -52,17 +135,35 @@ const LokiLangOps *loki_lang_for_file(const char *filename) {
     const char *ext = get_extension(filename);
     if (!ext) return NULL;
 
-    for (int i = 0; i < g_language_count; i++) {
-        const LokiLangOps *ops = g_languages[i];
-        for (int j = 0; j < LOKI_MAX_EXTENSIONS && ops->extensions[j]; j++) {
-            if (strcmp(ext, ops->extensions[j]) == 0) {
-                return ops;
-            }
-        }
+    unsigned int i = ext_hash(ext) & (LANG_EXT_SLOTS - 1);
+    while (g_by_ext[i].ext) {
+        if (strcmp(g_by_ext[i].ext, ext) == 0) return g_by_ext[i].ops;
+        i = (i + 1) & (LANG_EXT_SLOTS - 1);
     }
     return NULL;
 }
 
+const EditorLang *loki_lang_resolve(editor_ctx_t *ctx) {
+    EditorLang *lang = &ctx->model.lang;
+    const char *filename = ctx->model.filename;
+
+    if (lang->gen == g_generation && lang->filename == filename) return lang;
+
+    lang->filename = filename;
+    lang->gen = g_generation;
+    lang->ops = loki_lang_for_file(filename);
+    lang->syntax = filename ? syntax_for_filename(filename) : NULL;
+    lang->ts_lang = NULL;
+#ifdef LOKI_USE_LINENOISE
+    lang->ts_lang = treesitter_lang_from_filename(filename);
+#endif
+    return lang;
+}
+
+const LokiLangOps *loki_lang_for_buffer(editor_ctx_t *ctx) {
+    return loki_lang_resolve(ctx)->ops;
+}
+
 const LokiLangOps *loki_lang_by_name(const char *name) {
     if (!name) return NULL;
 
@@ -81,20 +182,55 @@ const LokiLangOps **loki_lang_all(int *count) {
 
 /* ======================= Convenience Functions ======================= */
 
+/* The SharedContext language buffers share (audio, MIDI, Link), made by
+ * the first language initialized rather than at startup. Left NULL if it
+ * can't be made; languages do without. */
+static SharedContext *shared_context = NULL;
+
+static void ensure_shared_context(editor_ctx_t *ctx) {
+    if (!shared_context) {
+        uint64_t start = uv_hrtime();
+        SharedContext *shared = malloc(sizeof(SharedContext));
+        if (!shared) return;
+        if (shared_context_init(shared) != 0) {
+            free(shared);
+            return;
+        }
+        shared_context = shared;
+        startup_note_deferred("shared context", start);
+    }
+    if (!ctx->model.shared) ctx->model.shared = shared_context;
+}
+
+void loki_lang_free_shared(void) {
+    if (!shared_context) return;
+    shared_context_cleanup(shared_context);
+    free(shared_context);
+    shared_context = NULL;
+}
+
+/* ops->init() for the buffer, timed: languages are initialized on first
+ * use (an eval, or the file opened), not with the editor */
+static int init_language(editor_ctx_t *ctx, const LokiLangOps *ops) {
+    if (!ops->init) return 0;
+    ensure_shared_context(ctx);
+    uint64_t start = uv_hrtime();
+    int ret = ops->init(ctx);
+    startup_note_deferred(ops->name, start);
+    return ret;
+}
+
 int loki_lang_init_for_file(editor_ctx_t *ctx) {
     if (!ctx) return -1;
 
-    const LokiLangOps *ops = loki_lang_for_file(ctx->model.filename);
+    const LokiLangOps *ops = loki_lang_for_buffer(ctx);
     if (!ops) return -1;  /* No language for this file type */
 
     if (ops->is_initialized && ops->is_initialized(ctx)) {
         return 0;  /* Already initialized */
     }
 
-    if (ops->init) {
-        return ops->init(ctx);
-    }
-    return 0;
+    return init_language(ctx, ops);
 }
 
 void loki_lang_cleanup_all(editor_ctx_t *ctx) {
@@ -108,76 +244,303 @@ void loki_lang_cleanup_all(editor_ctx_t *ctx) {
     }
 }
 
+static void ensure_event_handler(void);
+
 void loki_lang_check_callbacks(editor_ctx_t *ctx, lua_State *L) {
     if (!ctx) return;
+    ensure_event_handler();
 
     for (int i = 0; i < g_language_count; i++) {
         const LokiLangOps *ops = g_languages[i];
-        if (ops->check_callbacks) {
-            ops->check_callbacks(ctx, L);
+        if (!ops->check_callbacks) continue;
+        if (ops->callbacks_signalled && !atomic_exchange(&g_callbacks_pending[i], 0))
+            continue;
+        ops->check_callbacks(ctx, L);
+    }
+}
+
+int loki_lang_has_callbacks(void) {
+    for (int i = 0; i < g_language_count; i++) {
+        if (g_languages[i]->check_callbacks && !g_languages[i]->callbacks_signalled)
+            return 1;
+    }
+    return 0;
+}
+
+/* ======================= Asynchronous Evaluation ======================= */
+
+/* 'joining' is the flag of the job whose completion it is, else NULL */
+static void push_lang_event(int64_t id, int kind, double fraction, const char *message,
+                            atomic_int *joining) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = LANG_ASYNC_EVENT;
+    ev.data.user.i64[0] = id;
+    ev.data.user.i64[1] = kind;
+    ev.data.user.f64[0] = fraction;
+    ev.heap_data = message ? strdup(message) : NULL;
+
+    if (kind != LANG_EVENT_DONE) {
+        /* Only the latest of a job's progress, or of a language's
+         * callbacks pending, matters */
+        ev.coalesce_key = ((uint64_t)kind << 32) | (uint64_t)id;
+        if (async_queue_push(NULL, &ev) < 0) free(ev.heap_data);
+        return;
+    }
+    /* Completion must not be lost; wait for room in the queue, unless
+     * finish_job() is waiting for us: then the main thread isn't draining
+     * it, and hands the result over itself */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (joining && atomic_load(joining)) {
+            free(ev.heap_data);
+            return;
         }
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+void loki_lang_callbacks_pending(const LokiLangOps *ops) {
+    for (int i = 0; i < g_language_count; i++) {
+        if (g_languages[i] != ops) continue;
+        atomic_store(&g_callbacks_pending[i], 1);
+        /* Dispatching it wakes the main loop, which runs them */
+        if (async_queue_global()) push_lang_event(i, LANG_EVENT_CALLBACKS, 0, NULL, NULL);
+        return;
     }
 }
 
+void loki_lang_eval_progress(LokiLangEvalJob *job, double fraction, const char *message) {
+    if (async_queue_global()) push_lang_event(job->id, LANG_EVENT_PROGRESS, fraction, message, NULL);
+}
+
+void loki_lang_eval_fail(LokiLangEvalJob *job, const char *message) {
+    snprintf(job->error, sizeof(job->error), "%s", message ? message : "eval failed");
+}
+
+int loki_lang_eval_cancelled(const LokiLangEvalJob *job) {
+    return atomic_load(&job->cancelled);
+}
+
+editor_ctx_t *loki_lang_eval_ctx(const LokiLangEvalJob *job) {
+    return job->ctx;
+}
+
+/* Join a job's worker, hand its result to the language, unless it was
+ * cancelled, and forget it. Returns the result. */
+static int finish_job(LokiLangEvalJob *job) {
+    atomic_store(&job->joining, 1);
+    if (job->threaded) uv_thread_join(&job->thread);
+
+    LokiLangEvalJob **pp = &g_jobs;
+    while (*pp != job) pp = &(*pp)->next;
+    *pp = job->next;
+
+    int result = job->result;
+    if (!atomic_load(&job->cancelled)) {
+        if (result != 0)
+            snprintf(g_eval_error, sizeof(g_eval_error), "%s",
+                     job->error[0] ? job->error : "eval failed");
+        if (job->ops->eval_done) job->ops->eval_done(job->ctx, result);
+    }
+    free(job->code);
+    free(job);
+    return result;
+}
+
+static void lang_event_handler(AsyncEvent *event, void *arg) {
+    int kind = (int)event->data.user.i64[1];
+    if (kind == LANG_EVENT_CALLBACKS) {
+        editor_ctx_t *ctx = arg;
+        if (ctx && ctx_L(ctx)) loki_lang_check_callbacks(ctx, ctx_L(ctx));
+        return;
+    }
+
+    int id = (int)event->data.user.i64[0];
+    LokiLangEvalJob *job = g_jobs;
+    while (job && job->id != id) job = job->next;
+    if (!job || atomic_load(&job->cancelled)) {
+        if (job && kind == LANG_EVENT_DONE) finish_job(job);
+        return;
+    }
+
+    editor_ctx_t *ctx = job->ctx;
+    const char *name = job->ops->name;
+    if (kind == LANG_EVENT_DONE) {
+        if (finish_job(job) == 0)
+            editor_set_status_msg(ctx, "%s: done", name);
+        else
+            editor_set_status_msg(ctx, "%s error: %s", name, g_eval_error);
+        return;
+    }
+    const char *message = event->heap_data ? event->heap_data : "evaluating...";
+    double fraction = event->data.user.f64[0];
+    if (fraction >= 0)
+        editor_set_status_msg(ctx, "%s: %s %d%%", name, message, (int)(fraction * 100));
+    else
+        editor_set_status_msg(ctx, "%s: %s", name, message);
+}
+
+static void ensure_event_handler(void) {
+    if (async_queue_global() == NULL) return;
+    if (async_queue_get_handler(NULL, LANG_ASYNC_EVENT) != lang_event_handler) {
+        async_queue_set_handler(NULL, LANG_ASYNC_EVENT, lang_event_handler);
+        async_event_set_type_name(LANG_ASYNC_EVENT, "lang");
+    }
+}
+
+static void eval_worker(void *arg) {
+    LokiLangEvalJob *job = arg;
+    job->result = job->ops->eval_async(job, job->code) == 0 ? 0 : -1;
+    /* Run by finish_job() itself, on the thread draining the queue */
+    if (!atomic_load(&job->joining))
+        push_lang_event(job->id, LANG_EVENT_DONE, 1.0, NULL, &job->joining);
+}
+
+/* Evaluate 'code' (malloc'ed; the job takes it) with ops->eval_async(),
+ * on a worker if the async event queue runs. Returns 1 if started there,
+ * else the result. */
+static int eval_start(editor_ctx_t *ctx, const LokiLangOps *ops, char *code) {
+    LokiLangEvalJob *job = calloc(1, sizeof(*job));
+    if (!job) {
+        free(code);
+        return -1;
+    }
+    job->id = g_next_job_id++;
+    job->ctx = ctx;
+    job->ops = ops;
+    job->code = code;
+    atomic_init(&job->cancelled, 0);
+    atomic_init(&job->joining, 0);
+
+    /* A newer evaluation of the buffer replaces the one running */
+    for (LokiLangEvalJob *j = g_jobs; j; j = j->next) {
+        if (j->ctx == ctx) atomic_store(&j->cancelled, 1);
+    }
+    job->next = g_jobs;
+    g_jobs = job;
+
+    if (async_queue_global()) {
+        ensure_event_handler();
+        job->threaded = 1;
+        if (uv_thread_create(&job->thread, eval_worker, job) == 0) {
+            editor_set_status_msg(ctx, "%s: evaluating...", ops->name);
+            return 1;
+        }
+        job->threaded = 0;
+    }
+    /* No queue to report through (tests, the headless API), or no
+     * thread: evaluate it here */
+    job->result = ops->eval_async(job, code) == 0 ? 0 : -1;
+    return finish_job(job);
+}
+
+int loki_lang_eval_pending(editor_ctx_t *ctx) {
+    int n = 0;
+    for (LokiLangEvalJob *j = g_jobs; j; j = j->next) {
+        if (j->ctx == ctx) n++;
+    }
+    return n;
+}
+
+void loki_lang_eval_detach(editor_ctx_t *ctx) {
+    LokiLangEvalJob *j = g_jobs;
+    while (j) {
+        LokiLangEvalJob *next = j->next;
+        if (j->ctx == ctx) {
+            atomic_store(&j->cancelled, 1);
+            finish_job(j);
+        }
+        j = next;
+    }
+}
+
+/* Whether to evaluate with eval_async(): it is preferred while the queue
+ * runs, and used anyway by a language without another way */
+static int use_eval_async(const LokiLangOps *ops, int whole_buffer) {
+    if (!ops->eval_async) return 0;
+    if (async_queue_global()) return 1;
+    return !ops->eval && !(whole_buffer && ops->eval_buffer);
+}
+
 int loki_lang_eval(editor_ctx_t *ctx, const char *code) {
     if (!ctx || !code) return -1;
 
-    const LokiLangOps *ops = loki_lang_for_file(ctx->model.filename);
+    const LokiLangOps *ops = loki_lang_for_buffer(ctx);
     if (!ops) return -1;  /* No language for this file type */
 
     /* Ensure initialized */
     if (ops->is_initialized && !ops->is_initialized(ctx)) {
-        if (ops->init && ops->init(ctx) != 0) {
+        if (init_language(ctx, ops) != 0) {
             return -1;
         }
     }
 
+    g_eval_error[0] = '\0';
+    if (use_eval_async(ops, 0)) {
+        char *copy = strdup(code);
+        return copy ? eval_start(ctx, ops, copy) : -1;
+    }
     if (ops->eval) {
         return ops->eval(ctx, code);
     }
     return -1;
 }
 
+/* Destination of append_span(), sized by editor_model_export_size(). */
+struct export_buf {
+    char *data;
+    size_t len;
+};
+
+static int append_span(const char *data, size_t len, void *arg) {
+    struct export_buf *buf = arg;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
 int loki_lang_eval_buffer(editor_ctx_t *ctx) {
     if (!ctx || !ctx->model.filename) return -1;
 
-    const LokiLangOps *ops = loki_lang_for_file(ctx->model.filename);
-    if (!ops || !ops->eval) return -1;
+    const LokiLangOps *ops = loki_lang_for_buffer(ctx);
+    if (!ops || (!ops->eval && !ops->eval_buffer && !ops->eval_async)) return -1;
 
     /* Ensure initialized */
     if (ops->is_initialized && !ops->is_initialized(ctx)) {
-        if (ops->init && ops->init(ctx) != 0) {
+        if (init_language(ctx, ops) != 0) {
             return -1;
         }
     }
 
-    /* Build buffer content string */
     if (ctx->model.numrows == 0) return 0;
+    g_eval_error[0] = '\0';
+    int async = use_eval_async(ops, 1);
+    if (!async && ops->eval_buffer) return ops->eval_buffer(ctx);
 
-    size_t total = 0;
-    for (int i = 0; i < ctx->model.numrows; i++) {
-        total += ctx->model.row[i].size + 1;  /* +1 for newline */
-    }
-
-    char *code = malloc(total + 1);
-    if (!code) return -1;
-
-    char *p = code;
-    for (int i = 0; i < ctx->model.numrows; i++) {
-        memcpy(p, ctx->model.row[i].chars, ctx->model.row[i].size);
-        p += ctx->model.row[i].size;
-        *p++ = '\n';
-    }
-    *p = '\0';
-
-    int ret = ops->eval(ctx, code);
-    free(code);
+    /* Build buffer content string */
+    size_t total = editor_model_export_size(&ctx->model, EXPORT_NEWLINES);
+    struct export_buf buf;
+    buf.data = malloc(total + 1);
+    if (!buf.data) return -1;
+    buf.len = 0;
+    editor_model_export(&ctx->model, EXPORT_NEWLINES, append_span, &buf);
+    buf.data[buf.len] = '\0';
+    if (async) return eval_start(ctx, ops, buf.data);
+
+    int ret = ops->eval(ctx, buf.data);
+    free(buf.data);
     return ret;
 }
 
 void loki_lang_stop_all(editor_ctx_t *ctx) {
     if (!ctx) return;
 
+    /* Their completion is then dropped unreported */
+    for (LokiLangEvalJob *j = g_jobs; j; j = j->next) {
+        if (j->ctx == ctx) atomic_store(&j->cancelled, 1);
+    }
+
     for (int i = 0; i < g_language_count; i++) {
         const LokiLangOps *ops = g_languages[i];
         if (ops->stop && ops->is_initialized && ops->is_initialized(ctx)) {
@@ -227,17 +590,16 @@ int loki_lang_populate_shared_buffer(editor_ctx_t *ctx) {
 const char *loki_lang_get_error(editor_ctx_t *ctx) {
     if (!ctx) return NULL;
 
-    const LokiLangOps *ops = loki_lang_for_file(ctx->model.filename);
-    if (ops && ops->get_error) {
-        return ops->get_error(ctx);
-    }
-    return NULL;
+    const LokiLangOps *ops = loki_lang_for_buffer(ctx);
+    const char *err = ops && ops->get_error ? ops->get_error(ctx) : NULL;
+    if (!err && g_eval_error[0]) err = g_eval_error;
+    return err;
 }
 
 int loki_lang_configure_backend(editor_ctx_t *ctx, const char *sf_path, const char *csd_path) {
     if (!ctx) return -1;
 
-    const LokiLangOps *ops = loki_lang_for_file(ctx->model.filename);
+    const LokiLangOps *ops = loki_lang_for_buffer(ctx);
     if (!ops) return -1;  /* No language for this file type */
 
     if (!ops->configure_backend) return -1;  /* Language doesn't support backend config */
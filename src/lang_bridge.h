@@ -6,12 +6,26 @@
  *
  * Languages register themselves at startup, and core editor code dispatches
  * through this interface based on file extension or explicit language name.
+ *
+ * A language with eval_async() is evaluated off the UI thread: the bridge
+ * copies the code (the buffer's text, for a whole-buffer evaluation) and
+ * hands it to eval_async() on a worker thread of its own. The worker
+ * reports progress and failure with loki_lang_eval_progress() and
+ * loki_lang_eval_fail(); those, and its completion, reach the status bar
+ * through the async event queue (LANG_ASYNC_EVENT), and eval_done() is
+ * then called on the UI thread. A newer evaluation of the same buffer, or
+ * loki_lang_stop_all(), cancels the one running (loki_lang_eval_cancelled()).
+ *
+ * A language with callbacks_signalled set has its check_callbacks() run
+ * when it calls loki_lang_callbacks_pending() (from any thread), instead
+ * of on every turn of the main loop, which then needs no polling tick.
  */
 
 #ifndef LOKI_LANG_BRIDGE_H
 #define LOKI_LANG_BRIDGE_H
 
 #include "loki/core.h"  /* For editor_ctx_t */
+#include "async_queue.h"
 #include <lua.h>        /* For lua_State */
 
 /* Maximum number of registered languages */
@@ -20,6 +34,16 @@
 /* Maximum file extensions per language */
 #define LOKI_MAX_EXTENSIONS 4
 
+/* Async event of evaluations and callbacks (data.user.i64[0] = job id, or
+ * language index; data.user.i64[1] = kind) */
+#define LANG_ASYNC_EVENT (ASYNC_EVENT_USER + 6)
+
+/* Longest error message kept of an evaluation */
+#define LOKI_LANG_ERROR_SIZE 256
+
+/* An evaluation running on the bridge's worker (opaque) */
+typedef struct LokiLangEvalJob LokiLangEvalJob;
+
 /* ======================= Language Operations ======================= */
 
 /**
@@ -37,8 +61,10 @@ typedef struct LokiLangOps {
     void (*cleanup)(editor_ctx_t *ctx);            /* Cleanup resources */
     int (*is_initialized)(editor_ctx_t *ctx);      /* Check if initialized */
 
-    /* Main loop integration (optional) */
+    /* Main loop integration (optional). With callbacks_signalled, only
+     * run once loki_lang_callbacks_pending() says there is work. */
     void (*check_callbacks)(editor_ctx_t *ctx, lua_State *L);
+    int callbacks_signalled;
 
     /* Playback */
     int (*eval)(editor_ctx_t *ctx, const char *code);   /* Evaluate/play code */
@@ -57,6 +83,19 @@ typedef struct LokiLangOps {
 
     /* Lua API registration (optional) */
     void (*register_lua_api)(lua_State *L);              /* Register language's Lua bindings */
+
+    /* Whole-buffer evaluation (optional). Languages that can consume the
+     * document incrementally walk ctx->model with editor_model_export()
+     * here; without it eval() receives one concatenated copy. */
+    int (*eval_buffer)(editor_ctx_t *ctx);
+
+    /* Evaluation off the UI thread (optional; preferred over eval() and
+     * eval_buffer() when the async event queue runs). Called on a worker
+     * with its own copy of the code; it must not touch the editor, and
+     * returns 0 or -1. eval_done() (optional) gets that result on the UI
+     * thread, unless the evaluation was cancelled. */
+    int (*eval_async)(LokiLangEvalJob *job, const char *code);
+    void (*eval_done)(editor_ctx_t *ctx, int result);
 } LokiLangOps;
 
 /* ======================= Registration ======================= */
@@ -80,6 +119,30 @@ int loki_lang_register(const LokiLangOps *ops);
  */
 const LokiLangOps *loki_lang_for_file(const char *filename);
 
+/**
+ * Get the languages of ctx's buffer: the language ops, highlighting rules
+ * and tree-sitter grammar its filename selects. They are looked up once and
+ * kept on ctx->model until model.filename changes or a language registry
+ * does (loki_lang_generation()).
+ *
+ * @param ctx Editor context
+ * @return The model's EditorLang, never NULL
+ */
+const struct EditorLang *loki_lang_resolve(editor_ctx_t *ctx);
+
+/**
+ * loki_lang_resolve(ctx)->ops: the language of ctx's buffer, or NULL.
+ */
+const LokiLangOps *loki_lang_for_buffer(editor_ctx_t *ctx);
+
+/**
+ * Generation of the language registries, never 0. Bumped by
+ * loki_lang_register() and by loki_lang_registry_changed(), which the
+ * dynamic syntax registry calls when it changes.
+ */
+unsigned long loki_lang_generation(void);
+void loki_lang_registry_changed(void);
+
 /**
  * Get language operations by name.
  *
@@ -100,13 +163,21 @@ const LokiLangOps **loki_lang_all(int *count);
 
 /**
  * Initialize language for current file.
- * Dispatches to appropriate language based on ctx->model.filename.
+ * Dispatches to appropriate language based on ctx->model.filename. The
+ * first language initialized also makes the SharedContext the language
+ * buffers share (ctx->model.shared).
  *
  * @param ctx Editor context
  * @return 0 on success, -1 on error (including no language for file)
  */
 int loki_lang_init_for_file(editor_ctx_t *ctx);
 
+/**
+ * Free the SharedContext made for the languages, once they are cleaned
+ * up. Buffers still pointing at it must not use it after this.
+ */
+void loki_lang_free_shared(void);
+
 /**
  * Cleanup all initialized languages.
  *
@@ -122,26 +193,100 @@ void loki_lang_cleanup_all(editor_ctx_t *ctx);
  */
 void loki_lang_check_callbacks(editor_ctx_t *ctx, lua_State *L);
 
+/**
+ * Check whether any registered language polls for callbacks.
+ * The main loop keeps a periodic tick for them while this is true.
+ *
+ * @return 1 if some language implements check_callbacks without
+ *         callbacks_signalled, 0 otherwise
+ */
+int loki_lang_has_callbacks(void);
+
+/**
+ * Say that a language with callbacks_signalled has callbacks to run:
+ * its check_callbacks() runs on the UI thread once the event is
+ * dispatched. Safe from any thread.
+ *
+ * @param ops The language
+ */
+void loki_lang_callbacks_pending(const LokiLangOps *ops);
+
 /**
  * Evaluate code with language for current file.
  *
  * @param ctx Editor context
  * @param code Code to evaluate
- * @return 0 on success, -1 on error (including no language for file)
+ * @return 0 on success, 1 if started on the worker (the result comes to
+ *         the status bar), -1 on error (including no language for file)
  */
 int loki_lang_eval(editor_ctx_t *ctx, const char *code);
 
 /**
  * Evaluate entire buffer content with language for current file.
- * Concatenates all rows and evaluates as a single string.
+ * Uses the language's eval_async() or eval_buffer() when it has one,
+ * otherwise concatenates all rows and evaluates them as a single string.
  *
  * @param ctx Editor context
- * @return 0 on success, -1 on error
+ * @return 0 on success, 1 if started on the worker, -1 on error
  */
 int loki_lang_eval_buffer(editor_ctx_t *ctx);
 
+/* ======================= Asynchronous Evaluation ======================= */
+
+/**
+ * Report the progress of an evaluation (worker thread). Only the latest
+ * report of a job is shown.
+ *
+ * @param job The evaluation
+ * @param fraction Done so far, 0 to 1 (negative: not known)
+ * @param message What it is doing (or NULL)
+ */
+void loki_lang_eval_progress(LokiLangEvalJob *job, double fraction, const char *message);
+
+/**
+ * Set the error an evaluation fails with (worker thread); it is shown
+ * when eval_async() returns -1.
+ *
+ * @param job The evaluation
+ * @param message The error
+ */
+void loki_lang_eval_fail(LokiLangEvalJob *job, const char *message);
+
+/**
+ * Whether an evaluation was cancelled, and eval_async() should return.
+ *
+ * @param job The evaluation
+ * @return 1 if cancelled, 0 otherwise
+ */
+int loki_lang_eval_cancelled(const LokiLangEvalJob *job);
+
+/**
+ * The buffer an evaluation is of, for the language to find its own state
+ * in (not to read the buffer from the worker).
+ *
+ * @param job The evaluation
+ * @return Its editor context
+ */
+editor_ctx_t *loki_lang_eval_ctx(const LokiLangEvalJob *job);
+
+/**
+ * Count the evaluations of a buffer not finished yet.
+ *
+ * @param ctx Editor context
+ * @return Evaluations running, or done and not yet reported
+ */
+int loki_lang_eval_pending(editor_ctx_t *ctx);
+
+/**
+ * Cancel the evaluations of a buffer, wait for their workers and forget
+ * them, unreported. For a buffer about to be freed.
+ *
+ * @param ctx Editor context
+ */
+void loki_lang_eval_detach(editor_ctx_t *ctx);
+
 /**
- * Stop playback for all languages.
+ * Stop playback for all languages, and cancel the evaluations of ctx.
  *
  * @param ctx Editor context
  */
@@ -9,7 +9,10 @@
 
 #include "internal.h"
 #include "syntax.h"
+#include "lang_bridge.h"
+#include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -33,34 +36,18 @@
  * Full language definitions load dynamically from Lua (.loki/languages/).
  * These entries have minimal keywords suitable for testing and markdown code blocks. */
 
+/* Languages of syntax/builtin.h are highlighted by their generated
+ * highlighter */
+#define GENERATED_ENTRY(name, ext, kw, scs, mcs, mce, seps) \
+    { ext, kw, scs, mcs, mce, seps, \
+      HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS, HL_TYPE_GENERATED, NULL, \
+      syntax_scan_##name },
+
 struct t_editor_syntax HLDB[] = {
-    /* C/C++ - minimal definition for tests and markdown */
-    {
-        C_HL_extensions,
-        C_HL_keywords,
-        "//","/*","*/",
-        ",.()+-/*=~%<>[]{}:;",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-        HL_TYPE_C
-    },
-    /* Python - minimal definition for tests and markdown */
-    {
-        Python_HL_extensions,
-        Python_HL_keywords,
-        "#","","",
-        ",.()+-/*=~%<>[]{}:;",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-        HL_TYPE_C
-    },
-    /* Lua - minimal definition for tests and markdown */
-    {
-        Lua_HL_extensions,
-        Lua_HL_keywords,
-        "--","","",
-        ",.()+-/*=~%<>[]{}:;",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-        HL_TYPE_C
-    },
+    /* C/C++, Python, Lua - minimal definitions for tests and markdown */
+    LOKI_LANG_C(GENERATED_ENTRY)
+    LOKI_LANG_PYTHON(GENERATED_ENTRY)
+    LOKI_LANG_LUA(GENERATED_ENTRY)
     /* Markdown - special handling via markdown module */
     {
         MD_HL_extensions,
@@ -68,19 +55,14 @@ struct t_editor_syntax HLDB[] = {
         "","","",
         ",.()+-/*=~%[]{}:;",
         0,
-        HL_TYPE_MARKDOWN
+        HL_TYPE_MARKDOWN,
+        NULL,
+        NULL
     },
     /* Scheme R7RS (.scm, .ss, .sld) */
-    {
-        Scheme_HL_extensions,
-        Scheme_HL_keywords,
-        ";","","",
-        "()[]{}\"'`,@#",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-        HL_TYPE_C
-    },
+    LOKI_LANG_SCHEME(GENERATED_ENTRY)
     /* Terminator */
-    {NULL, NULL, "", "", "", NULL, 0, HL_TYPE_C}
+    {NULL, NULL, "", "", "", NULL, 0, HL_TYPE_C, NULL, NULL}
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB)/sizeof(HLDB[0]))
@@ -92,27 +74,42 @@ unsigned int loki_get_builtin_language_count(void) {
 
 /* ======================= Helper Functions for Markdown ==================== */
 
+/* Rules for code blocks inside markdown, by CB_LANG_*. Compiled on first
+ * use; markdown is highlighted on the main thread only. */
+#define CB_SEPARATORS ",.()+-/*=~%[];"
+static struct t_editor_syntax code_block_syntax[] = {
+    [CB_LANG_NONE]   = { NULL, NULL, "", "", "", CB_SEPARATORS, 0, HL_TYPE_C, NULL, NULL },
+    [CB_LANG_C]      = { NULL, C_HL_keywords, "//", "", "", CB_SEPARATORS, 0, HL_TYPE_C, NULL, NULL },
+    [CB_LANG_PYTHON] = { NULL, Python_HL_keywords, "#", "", "", CB_SEPARATORS, 0, HL_TYPE_C, NULL, NULL },
+    [CB_LANG_LUA]    = { NULL, Lua_HL_keywords, "--", "", "", CB_SEPARATORS, 0, HL_TYPE_C, NULL, NULL },
+    [CB_LANG_CYTHON] = { NULL, Cython_HL_keywords, "#", "", "", CB_SEPARATORS, 0, HL_TYPE_C, NULL, NULL },
+};
+
 /* Helper function to highlight code block content with specified language rules.
- * This is a simplified version of editor_update_syntax for use within markdown. */
-void highlight_code_line(t_erow *row, char **keywords, char *scs, char *separators) {
+ * This is a simplified version of editor_update_syntax for use within markdown.
+ * 'syntax' must be compiled (syntax_compile_keywords()). */
+void highlight_code_line(t_erow *row, struct t_editor_syntax *syntax) {
     if (row->rsize == 0) return;
 
+    const unsigned char *cc = syntax_char_classes(syntax);
+    if (!cc) return;
+    char *scs = syntax->singleline_comment_start;
     int i = 0, prev_sep = 1, in_string = 0;
     char *p = row->render;
 
     while (i < row->rsize) {
         /* Handle // or # comments (if scs is provided) */
-        if (scs && scs[0] && prev_sep && i < row->rsize - 1 &&
+        if (scs[0] && prev_sep && i < row->rsize - 1 &&
             p[i] == scs[0] && (scs[1] == '\0' || p[i+1] == scs[1])) {
-            memset(row->hl + i, HL_COMMENT, row->rsize - i);
+            memset(row->hl_buf.hl + i, HL_COMMENT, row->rsize - i);
             return;
         }
 
         /* Handle strings */
         if (in_string) {
-            row->hl[i] = HL_STRING;
+            row->hl_buf.hl[i] = HL_STRING;
             if (i < row->rsize - 1 && p[i] == '\\') {
-                row->hl[i+1] = HL_STRING;
+                row->hl_buf.hl[i+1] = HL_STRING;
                 i += 2;
                 prev_sep = 0;
                 continue;
@@ -123,45 +120,38 @@ void highlight_code_line(t_erow *row, char **keywords, char *scs, char *separato
             continue;
         }
 
-        if (p[i] == '"' || p[i] == '\'') {
+        if (cc[(unsigned char)p[i]] & SYNTAX_CC_QUOTE) {
             in_string = p[i];
-            row->hl[i] = HL_STRING;
+            row->hl_buf.hl[i] = HL_STRING;
             i++;
             prev_sep = 0;
             continue;
         }
 
         /* Handle numbers */
-        if ((isdigit(p[i]) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (p[i] == '.' && i > 0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
+        if (((cc[(unsigned char)p[i]] & SYNTAX_CC_DIGIT) &&
+             (prev_sep || row->hl_buf.hl[i-1] == HL_NUMBER)) ||
+            (p[i] == '.' && i > 0 && row->hl_buf.hl[i-1] == HL_NUMBER)) {
+            row->hl_buf.hl[i] = HL_NUMBER;
             i++;
             prev_sep = 0;
             continue;
         }
 
         /* Handle keywords */
-        if (prev_sep && keywords) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!memcmp(p+i,keywords[j],klen) &&
-                    (i+klen >= row->rsize || syntax_is_separator(p[i+klen], separators))) {
-                    memset(row->hl+i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    prev_sep = 0;
-                    goto next;
-                }
+        if (prev_sep) {
+            int hl;
+            int klen = syntax_keyword_at(syntax, p + i, row->rsize - i, &hl);
+            if (klen) {
+                memset(row->hl_buf.hl + i, hl, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
             }
         }
 
-        prev_sep = syntax_is_separator(p[i], separators);
+        prev_sep = (cc[(unsigned char)p[i]] & SYNTAX_CC_SEP) != 0;
         i++;
-next:
-        continue;
     }
 }
 
@@ -191,52 +181,131 @@ int detect_code_block_language(const char *line) {
     return CB_LANG_NONE;
 }
 
+/* Code block language opened by a fence whose info string is 'lang' */
+static int fence_lang(const char *lang) {
+    while (*lang && isspace((unsigned char)*lang)) lang++;
+
+    if (strncmp(lang, "cython", 6) == 0 ||
+        strncmp(lang, "pyx", 3) == 0 ||
+        strncmp(lang, "pxd", 3) == 0) {
+        return CB_LANG_CYTHON;
+    } else if (strncmp(lang, "c", 1) == 0 &&
+        (lang[1] == '\0' || isspace((unsigned char)lang[1]) || lang[1] == 'p')) {
+        if (lang[1] == 'p' && lang[2] == 'p') return CB_LANG_C; /* C++ */
+        if (lang[1] == '\0' || isspace((unsigned char)lang[1])) return CB_LANG_C;
+    } else if (strncmp(lang, "python", 6) == 0 || strncmp(lang, "py", 2) == 0) {
+        return CB_LANG_PYTHON;
+    } else if (strncmp(lang, "lua", 3) == 0) {
+        return CB_LANG_LUA;
+    }
+    return CB_LANG_NONE;
+}
+
+static int is_fence(const t_erow *row) {
+    return row->size >= 3 && row->chars[0] == '`' && row->chars[1] == '`' &&
+           row->chars[2] == '`';
+}
+
+/* ============================ Fence index ================================ */
+
+/* The fences of the document in row order, with the code block language
+ * in effect after each. Whether a row is inside a code block then takes a
+ * binary search instead of highlighting every row above it. Rows above
+ * 'scanned' are indexed; an edit truncates the index to the edited row and
+ * it is extended again, by looking at the first bytes of each row, only
+ * as far as a lookup needs. */
+struct FenceIndex {
+    int *rows;
+    unsigned char *after;       /* CB_LANG_* after the fence row */
+    int n, cap;
+    int scanned;
+};
+
+void markdown_fences_truncate(EditorModel *model, int at) {
+    struct FenceIndex *fi = model->fences;
+    if (!fi || at >= fi->scanned) return;
+    if (at < 0) at = 0;
+    while (fi->n > 0 && fi->rows[fi->n-1] >= at) fi->n--;
+    fi->scanned = at;
+}
+
+void markdown_fences_free(EditorModel *model) {
+    if (!model->fences) return;
+    free(model->fences->rows);
+    free(model->fences->after);
+    free(model->fences);
+    model->fences = NULL;
+}
+
+static void fences_scan_to(EditorModel *model, int at) {
+    struct FenceIndex *fi = model->fences;
+    if (at > model->numrows) at = model->numrows;
+
+    for (; fi->scanned < at; fi->scanned++) {
+        const t_erow *row = &model->row[fi->scanned];
+        if (!is_fence(row)) continue;
+
+        if (fi->n == fi->cap) {
+            int cap = fi->cap ? fi->cap * 2 : 64;
+            int *rows = realloc(fi->rows, (size_t)cap * sizeof(int));
+            if (rows) fi->rows = rows;
+            unsigned char *after = realloc(fi->after, (size_t)cap);
+            if (after) fi->after = after;
+            if (!rows || !after) {
+                perror("Out of memory");
+                exit(1);
+            }
+            fi->cap = cap;
+        }
+        int entry = fi->n ? fi->after[fi->n-1] : CB_LANG_NONE;
+        fi->rows[fi->n] = fi->scanned;
+        fi->after[fi->n] = entry != CB_LANG_NONE ? CB_LANG_NONE
+                                                 : fence_lang(row->chars + 3);
+        fi->n++;
+    }
+}
+
+int markdown_entry_state(editor_ctx_t *ctx, int at) {
+    EditorModel *model = &ctx->model;
+    if (at <= 0 || at > model->numrows) return CB_LANG_NONE;
+    if (!model->fences) {
+        model->fences = calloc(1, sizeof(*model->fences));
+        if (!model->fences) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    fences_scan_to(model, at);
+
+    /* Last fence above 'at' */
+    struct FenceIndex *fi = model->fences;
+    int lo = 0, hi = fi->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (fi->rows[mid] < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 ? fi->after[lo-1] : CB_LANG_NONE;
+}
+
 /* Update syntax highlighting for markdown files (proper editor integration).
  * This is the main entry point called by the editor core. */
 void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
-    unsigned char *new_hl = realloc(row->hl, row->rsize);
-    if (new_hl == NULL) return;
-    row->hl = new_hl;
-    memset(row->hl, HL_NORMAL, row->rsize);
+    editor_row_reserve(&ctx->model, row, ROW_BUF_HL, row->rsize,
+                       &ctx->model.alloc_stats.hl);
+    memset(row->hl_buf.hl, HL_NORMAL, row->rsize);
 
     char *p = row->render;
     int i = 0;
-    int prev_cb_lang = (row->idx > 0 && ctx && ctx->model.row) ? ctx->model.row[row->idx - 1].cb_lang : CB_LANG_NONE;
+    int prev_cb_lang = markdown_entry_state(ctx, editor_row_index(ctx, row));
+    row->cb_entry = prev_cb_lang;
 
     /* Code blocks: lines starting with ``` */
-    if (row->rsize >= 3 && p[0] == '`' && p[1] == '`' && p[2] == '`') {
+    if (is_fence(row)) {
         /* Opening or closing code fence */
-        memset(row->hl, HL_STRING, row->rsize);
-
-        if (prev_cb_lang != CB_LANG_NONE) {
-            /* Closing fence */
-            row->cb_lang = CB_LANG_NONE;
-        } else {
-            /* Opening fence - detect language */
-            row->cb_lang = CB_LANG_NONE;
-            if (row->rsize > 3) {
-                char *lang = p + 3;
-                /* Skip whitespace */
-                while (*lang && isspace(*lang)) lang++;
-
-                if (strncmp(lang, "cython", 6) == 0 ||
-                    strncmp(lang, "pyx", 3) == 0 ||
-                    strncmp(lang, "pxd", 3) == 0) {
-                    row->cb_lang = CB_LANG_CYTHON;
-                } else if (strncmp(lang, "c", 1) == 0 &&
-                    (lang[1] == '\0' || isspace(lang[1]) || lang[1] == 'p')) {
-                    if (lang[1] == 'p' && lang[2] == 'p') {
-                        row->cb_lang = CB_LANG_C; /* C++ */
-                    } else if (lang[1] == '\0' || isspace(lang[1])) {
-                        row->cb_lang = CB_LANG_C; /* C */
-                    }
-                } else if (strncmp(lang, "python", 6) == 0 || strncmp(lang, "py", 2) == 0) {
-                    row->cb_lang = CB_LANG_PYTHON;
-                } else if (strncmp(lang, "lua", 3) == 0) {
-                    row->cb_lang = CB_LANG_LUA;
-                }
-            }
-        }
+        memset(row->hl_buf.hl, HL_STRING, row->rsize);
+        row->cb_lang = prev_cb_lang != CB_LANG_NONE ? CB_LANG_NONE
+                                                    : fence_lang(row->chars + 3);
         return;
     }
 
@@ -244,30 +313,11 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
     if (prev_cb_lang != CB_LANG_NONE) {
         row->cb_lang = prev_cb_lang;
 
-        char **keywords = NULL;
-        char *scs = NULL;
-        char *separators = ",.()+-/*=~%[];";
-
-        switch (prev_cb_lang) {
-            case CB_LANG_C:
-                keywords = C_HL_keywords;
-                scs = "//";
-                break;
-            case CB_LANG_PYTHON:
-                keywords = Python_HL_keywords;
-                scs = "#";
-                break;
-            case CB_LANG_LUA:
-                keywords = Lua_HL_keywords;
-                scs = "--";
-                break;
-            case CB_LANG_CYTHON:
-                keywords = Cython_HL_keywords;
-                scs = "#";
-                break;
-        }
-
-        highlight_code_line(row, keywords, scs, separators);
+        struct t_editor_syntax *cb = &code_block_syntax[CB_LANG_NONE];
+        if (prev_cb_lang > 0 && prev_cb_lang <= CB_LANG_CYTHON)
+            cb = &code_block_syntax[prev_cb_lang];
+        if (syntax_compile_keywords(cb) != 0) return;
+        highlight_code_line(row, cb);
         return;
     }
 
@@ -281,7 +331,7 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
             header_len++;
         if (header_len < row->rsize && (p[header_len] == ' ' || p[header_len] == '\t')) {
             /* Valid header - highlight entire line */
-            memset(row->hl, HL_KEYWORD1, row->rsize);
+            memset(row->hl_buf.hl, HL_KEYWORD1, row->rsize);
             return;
         }
     }
@@ -289,7 +339,7 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
     /* Lists: lines starting with *, -, or + followed by space */
     if (row->rsize >= 2 && (p[0] == '*' || p[0] == '-' || p[0] == '+') &&
         (p[1] == ' ' || p[1] == '\t')) {
-        row->hl[0] = HL_KEYWORD2;
+        row->hl_buf.hl[0] = HL_KEYWORD2;
     }
 
     /* Inline patterns: bold, italic, code, links */
@@ -297,14 +347,14 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
     while (i < row->rsize) {
         /* Inline code: `text` */
         if (p[i] == '`') {
-            row->hl[i] = HL_STRING;
+            row->hl_buf.hl[i] = HL_STRING;
             i++;
             while (i < row->rsize && p[i] != '`') {
-                row->hl[i] = HL_STRING;
+                row->hl_buf.hl[i] = HL_STRING;
                 i++;
             }
             if (i < row->rsize) {
-                row->hl[i] = HL_STRING; /* Closing ` */
+                row->hl_buf.hl[i] = HL_STRING; /* Closing ` */
                 i++;
             }
             continue;
@@ -317,7 +367,7 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
             while (i < row->rsize - 1) {
                 if (p[i] == '*' && p[i+1] == '*') {
                     /* Found closing ** */
-                    memset(row->hl + start, HL_KEYWORD2, i - start + 2);
+                    memset(row->hl_buf.hl + start, HL_KEYWORD2, i - start + 2);
                     i += 2;
                     break;
                 }
@@ -334,7 +384,7 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
             while (i < row->rsize) {
                 if (p[i] == marker) {
                     /* Found closing marker */
-                    memset(row->hl + start, HL_COMMENT, i - start + 1);
+                    memset(row->hl_buf.hl + start, HL_COMMENT, i - start + 1);
                     i++;
                     break;
                 }
@@ -355,7 +405,7 @@ void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row) {
                 while (i < row->rsize && p[i] != ')') i++;
                 if (i < row->rsize) {
                     /* Complete link found */
-                    memset(row->hl + start, HL_NUMBER, i - start + 1);
+                    memset(row->hl_buf.hl + start, HL_NUMBER, i - start + 1);
                     i++;
                     continue;
                 }
@@ -384,6 +434,157 @@ void editor_update_syntax_csound(editor_ctx_t *ctx, t_erow *row) {
 static struct t_editor_syntax **HLDB_dynamic = NULL;
 static int HLDB_dynamic_count = 0;
 
+/* ======================= Filename Matching ================================= */
+/* A filematch pattern matches where strstr() first finds it; a pattern
+ * starting with '.' only if that is the end of the name. The built-in
+ * languages come first, then the dynamic ones, and the first language with
+ * a matching pattern wins. Patterns that are a single extension (".py")
+ * are found through a hash table keyed by it; the rest (".tar.gz",
+ * "Makefile") are few and tried one by one. Rebuilt after the dynamic
+ * registry changes. */
+
+typedef struct FilematchEntry {
+    const char *pattern;
+    struct t_editor_syntax *syntax;
+    int order;                /* Position of syntax in the registries */
+} FilematchEntry;
+
+static struct {
+    int built;
+    FilematchEntry *ext;      /* Open addressing, ext_slots (power of two) */
+    unsigned int ext_slots;
+    FilematchEntry *other;    /* In registry order */
+    int nother;
+} filematch_index;
+
+static void filematch_index_free(void) {
+    free(filematch_index.ext);
+    free(filematch_index.other);
+    memset(&filematch_index, 0, sizeof(filematch_index));
+}
+
+static unsigned int filematch_hash(const char *ext) {
+    unsigned int h = 2166136261u;     /* FNV-1a */
+    while (*ext) {
+        h ^= (unsigned char)*ext++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct t_editor_syntax *registry_syntax(int order) {
+    int builtin = (int)loki_get_builtin_language_count();
+    return order < builtin ? &HLDB[order] : HLDB_dynamic[order - builtin];
+}
+
+/* Returns 0 on success, -1 when out of memory (lookups then scan) */
+static int filematch_index_build(void) {
+    int nsyntax = (int)loki_get_builtin_language_count() + HLDB_dynamic_count;
+    int npatterns = 0;
+    for (int j = 0; j < nsyntax; j++) {
+        char **fm = registry_syntax(j)->filematch;
+        for (int i = 0; fm && fm[i]; i++) npatterns++;
+    }
+
+    unsigned int slots = 16;
+    while (slots < 2u * (unsigned int)npatterns) slots *= 2;
+    filematch_index.ext = calloc(slots, sizeof(FilematchEntry));
+    filematch_index.other = malloc(sizeof(FilematchEntry) *
+                                   (size_t)(npatterns ? npatterns : 1));
+    if (!filematch_index.ext || !filematch_index.other) {
+        filematch_index_free();
+        return -1;
+    }
+    filematch_index.ext_slots = slots;
+
+    for (int j = 0; j < nsyntax; j++) {
+        struct t_editor_syntax *s = registry_syntax(j);
+        for (int i = 0; s->filematch && s->filematch[i]; i++) {
+            const char *pat = s->filematch[i];
+            FilematchEntry e = { pat, s, j };
+            if (pat[0] != '.' || strchr(pat + 1, '.')) {
+                filematch_index.other[filematch_index.nother++] = e;
+                continue;
+            }
+            unsigned int k = filematch_hash(pat) & (slots - 1);
+            while (filematch_index.ext[k].pattern &&
+                   strcmp(filematch_index.ext[k].pattern, pat) != 0)
+                k = (k + 1) & (slots - 1);
+            if (!filematch_index.ext[k].pattern) filematch_index.ext[k] = e;
+        }
+    }
+    filematch_index.built = 1;
+    return 0;
+}
+
+static int filematch_matches(const char *filename, const char *pattern) {
+    const char *p = strstr(filename, pattern);
+    return p && (pattern[0] != '.' || p[strlen(pattern)] == '\0');
+}
+
+/* Without an index: the registries in order */
+static struct t_editor_syntax *filematch_scan(const char *filename) {
+    int nsyntax = (int)loki_get_builtin_language_count() + HLDB_dynamic_count;
+    for (int j = 0; j < nsyntax; j++) {
+        struct t_editor_syntax *s = registry_syntax(j);
+        for (int i = 0; s->filematch && s->filematch[i]; i++) {
+            if (filematch_matches(filename, s->filematch[i])) return s;
+        }
+    }
+    return NULL;
+}
+
+static struct t_editor_syntax *syntax_lookup(const char *filename) {
+    if (!filematch_index.built && filematch_index_build() != 0)
+        return filematch_scan(filename);
+
+    struct t_editor_syntax *best = NULL;
+    int best_order = INT_MAX;
+
+    const char *ext = strrchr(filename, '.');
+    if (ext) {
+        unsigned int mask = filematch_index.ext_slots - 1;
+        unsigned int k = filematch_hash(ext) & mask;
+        while (filematch_index.ext[k].pattern) {
+            FilematchEntry *e = &filematch_index.ext[k];
+            if (strcmp(e->pattern, ext) == 0) {
+                /* Only if no earlier occurrence is what strstr() sees */
+                if (strstr(filename, ext) == ext) {
+                    best = e->syntax;
+                    best_order = e->order;
+                }
+                break;
+            }
+            k = (k + 1) & mask;
+        }
+    }
+
+    for (int i = 0; i < filematch_index.nother; i++) {
+        FilematchEntry *e = &filematch_index.other[i];
+        if (e->order >= best_order) break;
+        if (filematch_matches(filename, e->pattern)) return e->syntax;
+    }
+    return best;
+}
+
+static SyntaxMissHook miss_hook;
+static int in_miss_hook;    /* A loader opening files finds what there is */
+
+void syntax_set_miss_hook(SyntaxMissHook hook) {
+    miss_hook = hook;
+}
+
+struct t_editor_syntax *syntax_for_filename(const char *filename) {
+    struct t_editor_syntax *s = syntax_lookup(filename);
+    if (!s && miss_hook && !in_miss_hook) {
+        in_miss_hook = 1;
+        int again = miss_hook(filename);
+        in_miss_hook = 0;
+        if (again) s = syntax_lookup(filename);
+    }
+    return s;
+}
+
 /* Free a single dynamically allocated language definition */
 void free_dynamic_language(struct t_editor_syntax *lang) {
     if (!lang) return;
@@ -409,6 +610,7 @@ void free_dynamic_language(struct t_editor_syntax *lang) {
         free(lang->separators);
     }
 
+    syntax_free_keywords(lang);
     free(lang);
 }
 
@@ -420,12 +622,15 @@ void cleanup_dynamic_languages(void) {
     free(HLDB_dynamic);
     HLDB_dynamic = NULL;
     HLDB_dynamic_count = 0;
+    filematch_index_free();
+    loki_lang_registry_changed();
 }
 
 /* Add a new language definition dynamically
  * Returns 0 on success, -1 on error */
 int add_dynamic_language(struct t_editor_syntax *lang) {
     if (!lang) return -1;
+    if (syntax_compile_keywords(lang) != 0) return -1;
 
     /* Grow the dynamic array */
     struct t_editor_syntax **new_array = realloc(HLDB_dynamic,
@@ -437,6 +642,8 @@ int add_dynamic_language(struct t_editor_syntax *lang) {
     HLDB_dynamic = new_array;
     HLDB_dynamic[HLDB_dynamic_count] = lang;
     HLDB_dynamic_count++;
+    filematch_index_free();
+    loki_lang_registry_changed();
 
     return 0;
 }
@@ -30,8 +30,15 @@ unsigned int loki_get_builtin_language_count(void);
 #define HLDB_ENTRIES loki_get_builtin_language_count()
 
 /* Syntax highlighting functions */
-void highlight_code_line(t_erow *row, char **keywords, char *scs, char *separators);
+void highlight_code_line(t_erow *row, struct t_editor_syntax *syntax);
 void editor_update_syntax_markdown(editor_ctx_t *ctx, t_erow *row);
+
+/* Markdown fence index. markdown_entry_state() is the code block language
+ * (CB_LANG_*) in effect where row 'at' starts, from the fences above it.
+ * Row changes at 'at' and below must call markdown_fences_truncate(). */
+int markdown_entry_state(editor_ctx_t *ctx, int at);
+void markdown_fences_truncate(EditorModel *model, int at);
+void markdown_fences_free(EditorModel *model);
 void editor_update_syntax_csound(editor_ctx_t *ctx, t_erow *row);
 
 /* Dynamic language registration */
@@ -41,4 +48,8 @@ void cleanup_dynamic_languages(void);
 struct t_editor_syntax *get_dynamic_language(int index);
 int get_dynamic_language_count(void);
 
+/* Highlighting rules 'filename' selects: the first built-in, then dynamic,
+ * language with a matching filematch pattern. NULL if none. */
+struct t_editor_syntax *syntax_for_filename(const char *filename);
+
 #endif /* LOKI_LANGUAGES_H */
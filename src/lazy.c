@@ -0,0 +1,745 @@
+/* lazy.c - Files too large to load, shown a window of lines at a time
+ *
+ * See lazy.h for an overview. The window is the byte range [start, end)
+ * of the mapping, whole lines; it is loaded by indexing just that range
+ * with loader_index_lines() and building its rows as editor_open() does.
+ * In hex view the "lines" are the LAZY_HEX_BYTES byte runs of the file,
+ * so where one starts is a matter of arithmetic, and rows are formatted
+ * from the mapping instead.
+ *
+ * A remote file's mapping is its cache (see remote.h): every read of it
+ * goes after a fetch() of the bytes read, which costs nothing once they
+ * are present. Scans of an unknown length, skipping lines down or up the
+ * file or searching it, fetch a chunk at a time as they go.
+ */
+
+#define _DEFAULT_SOURCE     /* pread(), pwrite() */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lazy.h"
+#include "multicursor.h"
+#include "remote.h"
+#include "search.h"
+#include "task_pool.h"
+
+struct LazyFile {
+    LoadedFile file;
+    RemoteFile *remote;     /* Fetching the mapping's blocks, or NULL */
+    int failed;             /* A fetch failed since the last report */
+    LineCkpt ckpt;
+    Task *task;             /* Building the index, or NULL */
+    TaskToken token;
+    atomic_int idle;        /* The task has stopped, short of a remote end */
+    size_t start, end;      /* The window */
+    int base;               /* Line at 'start', or -1 while unknown */
+    int hex;                /* Binary, shown in hex */
+    int hexw;               /* Digits of the offsets shown */
+    int writable;           /* The mapping was made writable */
+    unsigned char *dirty;   /* A bit per LAZY_PAGE_BYTES changed, or NULL */
+    size_t ndirty;          /* Pages changed since the last save */
+};
+
+static size_t min_bytes = LAZY_MIN_BYTES;
+
+size_t lazy_min_bytes(void) {
+    return min_bytes;
+}
+
+void lazy_set_min_bytes(size_t bytes) {
+    min_bytes = bytes;
+}
+
+/* Make the bytes [from, to) of the mapping hold the file's: fetch them
+ * if it is remote. Returns 0, or -1 (noted for the status bar). */
+static int fetch(LazyFile *lz, size_t from, size_t to) {
+    if (lz->remote == NULL || to <= from) return 0;
+    if (remote_fetch(lz->remote, from, to - from) == 0) return 0;
+    lz->failed = 1;
+    return -1;
+}
+
+/* Show why a fetch failed, once */
+static void report_failed(editor_ctx_t *ctx, LazyFile *lz) {
+    if (!lz->failed) return;
+    lz->failed = 0;
+    editor_set_status_msg(ctx, "Cannot fetch: %s", remote_error(lz->remote));
+}
+
+/* Index the next slice. Returns 0 while there is more to index now: a
+ * remote file is indexed only over the blocks present from its start. */
+static int index_slice(LazyFile *lz) {
+    size_t bytes = LAZY_INDEX_SLICE;
+    if (lz->remote) {
+        size_t have = remote_prefix(lz->remote);
+        if (have < lz->file.size) {
+            if (have <= lz->ckpt.pos) return 1;
+            if (have - lz->ckpt.pos < bytes) bytes = have - lz->ckpt.pos;
+        }
+    }
+    return loader_ckpt_build(&lz->ckpt, bytes);
+}
+
+static void index_worker(void *arg) {
+    LazyFile *lz = arg;
+    while (!task_cancelled() && index_slice(lz) == 0) {
+    }
+    atomic_store(&lz->idle, 1);
+}
+
+/* Index a remote file on over the blocks fetched since its task stopped */
+static void index_resume(LazyFile *lz) {
+    if (lz->remote == NULL || lz->hex || !atomic_load(&lz->idle) ||
+        loader_ckpt_lines(&lz->ckpt) >= 0 || remote_prefix(lz->remote) <= lz->ckpt.pos)
+        return;
+    if (lz->task) task_wait(lz->task);
+    atomic_store(&lz->idle, 0);
+    lz->task = task_submit(index_worker, lz, TASK_PRIORITY_LOW, &lz->token);
+    if (lz->task == NULL) atomic_store(&lz->idle, 1);
+}
+
+/* Whether byte 'off' can be read, fetching its block if need be */
+static int readable(LazyFile *lz, size_t off) {
+    return lz->remote == NULL || fetch(lz, off, off + 1) == 0;
+}
+
+/* Start of the line 'n' lines above the one starting at 'off'. Sets
+ * *moved to the lines gone up, fewer at the top of the file. */
+static size_t lines_above(LazyFile *lz, size_t off, int n, int *moved) {
+    const char *data = lz->file.data;
+    int k = 0;
+    while (k < n && off > 0) {
+        off--;      /* Onto the '\n' ending the line above */
+        while (off > 0 && readable(lz, off - 1) && data[off - 1] != '\n') off--;
+        k++;
+    }
+    *moved = k;
+    return off;
+}
+
+/* Start of the line holding byte 'off' */
+static size_t line_start(LazyFile *lz, size_t off) {
+    while (off > 0 && readable(lz, off - 1) && lz->file.data[off - 1] != '\n') off--;
+    return off;
+}
+
+/* loader_skip_lines() over the file, a remote one fetched REMOTE_BLOCK
+ * bytes at a time until the lines are passed */
+static size_t skip_lines(LazyFile *lz, size_t from, int n, int *skipped) {
+    const char *data = lz->file.data;
+    size_t size = lz->file.size;
+    if (lz->remote == NULL) return loader_skip_lines(data, size, from, n, skipped);
+
+    size_t off = from, scan = from;
+    int done = 0;
+    while (done < n && scan < size) {
+        size_t to = size - scan > REMOTE_BLOCK ? scan + REMOTE_BLOCK : size;
+        if (fetch(lz, scan, to) == -1) break;
+        int k;
+        size_t next = loader_skip_lines(data, to, scan, n - done, &k);
+        if (k > 0) off = next;
+        done += k;
+        scan = to;
+    }
+    if (skipped) *skipped = done;
+    return off;
+}
+
+/* Hex rows are "<offset>: xx xx ... xx  <characters>": the columns of
+ * the two digits of byte 'i' of a row, and of its character */
+static int hex_col(const LazyFile *lz, int i) {
+    return lz->hexw + 2 + 3 * i;
+}
+
+static int char_col(const LazyFile *lz, int i) {
+    return lz->hexw + 2 + 3 * LAZY_HEX_BYTES + 1 + i;
+}
+
+/* The hex row of the bytes from 'off' into 'buf'. Returns its length. */
+static int hex_format(const LazyFile *lz, size_t off, char *buf) {
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)lz->file.data + off;
+    size_t n = off < lz->file.size ? lz->file.size - off : 0;
+    if (n > LAZY_HEX_BYTES) n = LAZY_HEX_BYTES;
+
+    int len = snprintf(buf, LAZY_HEX_ROW_MAX, "%0*zx: ", lz->hexw, off);
+    for (size_t i = 0; i < LAZY_HEX_BYTES; i++) {
+        buf[len++] = i < n ? digits[p[i] >> 4] : ' ';
+        buf[len++] = i < n ? digits[p[i] & 15] : ' ';
+        buf[len++] = ' ';
+    }
+    buf[len++] = ' ';
+    for (size_t i = 0; i < n; i++) buf[len++] = p[i] >= 0x20 && p[i] < 0x7f ? (char)p[i] : '.';
+    return len;
+}
+
+/* Start of the row holding byte 'off' */
+static size_t row_start(LazyFile *lz, size_t off) {
+    if (lz->hex) return off - off % LAZY_HEX_BYTES;
+    return line_start(lz, off);
+}
+
+/* Start of the row 'n' rows below the one at 'from', or of the last one */
+static size_t rows_below(LazyFile *lz, size_t from, int n) {
+    if (!lz->hex) return skip_lines(lz, from, n, NULL);
+    size_t last = row_start(lz, lz->file.size - 1);
+    size_t off = from + (size_t)n * LAZY_HEX_BYTES;
+    return off < last ? off : last;
+}
+
+/* Start of the row 'n' rows above the one at 'off', as lines_above() */
+static size_t rows_above(LazyFile *lz, size_t off, int n, int *moved) {
+    if (!lz->hex) return lines_above(lz, off, n, moved);
+    size_t k = off / LAZY_HEX_BYTES;
+    if (k > (size_t)n) k = (size_t)n;
+    *moved = (int)k;
+    return off - k * LAZY_HEX_BYTES;
+}
+
+/* Offset of row 'row' of the window: the end of the file past the last */
+static size_t row_offset(LazyFile *lz, int row) {
+    if (!lz->hex) return skip_lines(lz, lz->start, row, NULL);
+    size_t off = lz->start + (size_t)row * LAZY_HEX_BYTES;
+    return off < lz->file.size ? off : lz->file.size;
+}
+
+/* The hex rows of the window from 'start' */
+static size_t load_hex(editor_ctx_t *ctx, size_t start) {
+    LazyFile *lz = ctx->model.lazy;
+    char buf[LAZY_HEX_ROW_MAX];
+    size_t off = start;
+    fetch(lz, start, start + (size_t)LAZY_WINDOW_ROWS * LAZY_HEX_BYTES);
+    for (int r = 0; r < LAZY_WINDOW_ROWS && off < lz->file.size; r++) {
+        int len = hex_format(lz, off, buf);
+        editor_insert_row(ctx, ctx->model.numrows, buf, (size_t)len);
+        off += LAZY_HEX_BYTES;
+    }
+    return off < lz->file.size ? off : lz->file.size;
+}
+
+/* Replace the rows with the window of lines from 'start', which is line
+ * 'base' (-1: unknown). */
+static void load_window(editor_ctx_t *ctx, size_t start, int base) {
+    LazyFile *lz = ctx->model.lazy;
+    const char *data = lz->file.data;
+    size_t size = lz->file.size;
+    size_t end;
+
+    int had_arena = ctx->model.arena != NULL;
+    editor_model_free_rows(&ctx->model);
+    if (had_arena) editor_model_use_arena(&ctx->model);
+
+    if (lz->hex) {
+        end = load_hex(ctx, start);
+        base = (int)(start / LAZY_HEX_BYTES);
+    } else {
+        int lines;
+        end = skip_lines(lz, start, LAZY_WINDOW_ROWS, &lines);
+        if (lines < LAZY_WINDOW_ROWS && !lz->failed) end = size;
+
+        LineIndex index;
+        if (loader_index_lines(data + start, end - start, &index) == -1) {
+            editor_set_status_msg(ctx, "Cannot load lines: %s", strerror(errno));
+        } else if (index.binary) {
+            editor_set_status_msg(ctx, "Binary data at this position");
+        } else {
+            LoadedFile window = {data + start, end - start, 0, 0};
+            editor_append_lines(ctx, &window, &index);
+        }
+        loader_index_free(&index);
+    }
+    if (ctx->model.numrows == 0) editor_insert_row(ctx, 0, "", 0);
+    /* Changed bytes are in the mapping, and still to be saved */
+    ctx->model.dirty = (int)lz->ndirty;
+
+    lz->start = start;
+    lz->end = end;
+    lz->base = base;
+    ctx->view.sel_active = 0;
+    multicursor_clear(ctx);
+    report_failed(ctx, lz);
+    index_resume(lz);
+}
+
+/* Put the cursor on row 'row' of a window just loaded, in mid screen. */
+static void show_row(editor_ctx_t *ctx, int row) {
+    ctx->view.rowoff = row - ctx->view.screenrows / 2;
+    if (ctx->view.rowoff < 0) ctx->view.rowoff = 0;
+    ctx->view.cy = 0;
+    editor_cursor_to(ctx, row, 0);
+}
+
+static int open_lazy(editor_ctx_t *ctx, LoadedFile *file, RemoteFile *rf) {
+    LazyFile *lz = calloc(1, sizeof(LazyFile));
+    if (lz == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    lz->file = *file;
+    lz->remote = rf;
+    memset(file, 0, sizeof(*file));
+    const char *what = rf ? "Remote file: read-only, fetched as shown" :
+                            "Large file: read-only, loaded as shown";
+
+    /* Binary: no lines to index */
+    fetch(lz, 0, 1);
+    if (loader_is_binary(&lz->file)) {
+        lz->hex = 1;
+        lz->hexw = 8;
+        while (lz->hexw < 16 && (lz->file.size - 1) >> (4 * lz->hexw)) lz->hexw++;
+        ctx->model.lazy = lz;
+        editor_set_status_msg(ctx, rf ? "Binary file: hex view, read-only" :
+                              "Binary file: hex view, type over the bytes to change them");
+        load_window(ctx, 0, 0);
+        return 0;
+    }
+
+    if (loader_ckpt_init(&lz->ckpt, lz->file.data, lz->file.size) == -1) {
+        perror("Out of memory");
+        exit(1);
+    }
+    ctx->model.lazy = lz;
+
+    /* Without pool threads :N scans from the top, and :N% shows no line
+     * numbers */
+    task_token_init(&lz->token);
+    atomic_init(&lz->idle, 0);
+    lz->task = task_submit(index_worker, lz, TASK_PRIORITY_LOW, &lz->token);
+    if (lz->task == NULL) atomic_store(&lz->idle, 1);
+
+    editor_set_status_msg(ctx, "%s", what);
+    load_window(ctx, 0, 0);
+    return 0;
+}
+
+int lazy_open(editor_ctx_t *ctx, LoadedFile *file) {
+    return open_lazy(ctx, file, NULL);
+}
+
+int lazy_open_remote(editor_ctx_t *ctx, const char *url) {
+    LoadedFile file;
+    char err[256];
+    RemoteFile *rf = remote_open(url, &file, err, sizeof(err));
+    if (rf == NULL) {
+        editor_set_status_msg(ctx, "%s", err);
+        return -1;
+    }
+    return open_lazy(ctx, &file, rf);
+}
+
+void lazy_close(EditorModel *model) {
+    LazyFile *lz = model->lazy;
+    if (lz == NULL) return;
+    if (lz->task) {
+        task_token_cancel(&lz->token);
+        task_wait(lz->task);
+    }
+    loader_ckpt_free(&lz->ckpt);
+    loader_close(&lz->file);
+    remote_close(lz->remote);
+    free(lz->dirty);
+    free(lz);
+    model->lazy = NULL;
+}
+
+int lazy_base(EditorModel *model) {
+    LazyFile *lz = model->lazy;
+    if (lz == NULL) return 0;
+    index_resume(lz);
+    if (lz->base < 0) {
+        lz->base = loader_ckpt_line_of(&lz->ckpt, lz->start);
+        /* The gutters drawn without numbers are out of date */
+        if (lz->base >= 0) editor_model_damage_shift(model, 0);
+    }
+    return lz->base;
+}
+
+int lazy_lines(EditorModel *model) {
+    if (model->lazy == NULL) return model->numrows;
+    if (model->lazy->hex)
+        return (int)((model->lazy->file.size + LAZY_HEX_BYTES - 1) / LAZY_HEX_BYTES);
+    return loader_ckpt_lines(&model->lazy->ckpt);
+}
+
+/* loader_ckpt_seek() over the file, a remote one fetched as the scan
+ * from the checkpoint goes */
+static int seek_line(LazyFile *lz, int line, size_t *off) {
+    if (lz->remote == NULL) return loader_ckpt_seek(&lz->ckpt, line, off);
+    size_t from;
+    int base = loader_ckpt_near(&lz->ckpt, line, &from), skipped;
+    size_t at = skip_lines(lz, from, line - base, &skipped);
+    if (at < lz->file.size || skipped == 0) {
+        *off = at;
+        return base + skipped;
+    }
+    /* Past the final newline: back to the start of the last line */
+    *off = line_start(lz, at - 1);
+    return base + skipped - 1;
+}
+
+int lazy_goto(editor_ctx_t *ctx, int line) {
+    LazyFile *lz = ctx->model.lazy;
+    size_t off, start;
+    if (line < 0) line = 0;
+    if (lz->hex) {
+        int last = lazy_lines(&ctx->model) - 1;
+        if (line > last) line = last;
+        off = (size_t)line * LAZY_HEX_BYTES;
+    } else {
+        line = seek_line(lz, line, &off);
+    }
+
+    /* Half a window above it, unless the top of the file is nearer */
+    int moved;
+    start = rows_above(lz, off, LAZY_WINDOW_ROWS / 2, &moved);
+    load_window(ctx, start, line - moved);
+    show_row(ctx, moved);
+    return line;
+}
+
+void lazy_goto_percent(editor_ctx_t *ctx, int percent) {
+    LazyFile *lz = ctx->model.lazy;
+    size_t size = lz->file.size;
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+
+    /* The start of the line that byte is in */
+    size_t off = size / 100 * (size_t)percent + size % 100 * (size_t)percent / 100;
+    if (off >= size) off = size - 1;
+    off = row_start(lz, off);
+
+    int moved;
+    size_t start = rows_above(lz, off, LAZY_WINDOW_ROWS / 2, &moved);
+    load_window(ctx, start, start == 0 ? 0 : -1);
+    show_row(ctx, moved);
+}
+
+void lazy_follow_cursor(editor_ctx_t *ctx) {
+    LazyFile *lz = ctx->model.lazy;
+    if (lz == NULL) return;
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int shift;          /* Rows the window moves down the file by */
+    size_t start;
+
+    if (row >= ctx->model.numrows - LAZY_MARGIN_ROWS && lz->end < lz->file.size) {
+        shift = row - LAZY_WINDOW_ROWS / 2;
+        start = rows_below(lz, lz->start, shift);
+    } else if (row < LAZY_MARGIN_ROWS && lz->start > 0) {
+        int moved;
+        start = rows_above(lz, lz->start, LAZY_WINDOW_ROWS / 2 - row, &moved);
+        shift = -moved;
+    } else {
+        return;
+    }
+
+    int base = lz->base >= 0 ? lz->base + shift : -1;
+    int rowoff = ctx->view.rowoff - shift;
+    load_window(ctx, start, start == 0 ? 0 : base);
+    row -= shift;
+    ctx->view.rowoff = rowoff < 0 ? 0 : rowoff;
+    if (ctx->view.rowoff > row) ctx->view.rowoff = row;
+    ctx->view.cy = row - ctx->view.rowoff;
+}
+
+/* Offset of the first match of 'pat' starting in [lo, hi), or -1. A
+ * remote file is fetched and searched REMOTE_FETCH_MAX bytes at a time,
+ * so a match near 'lo' is found without fetching the bytes after. */
+static long long first_match(LazyFile *lz, const SearchPattern *pat,
+                             size_t lo, size_t hi) {
+    const char *data = lz->file.data;
+    size_t size = lz->file.size;
+    size_t step = lz->remote ? REMOTE_FETCH_MAX : hi - lo;
+    while (hi > lo) {
+        size_t stop = hi - lo > step ? lo + step : hi;
+        size_t to = stop + (size_t)pat->len - 1;    /* Matches may end past stop */
+        if (to > size) to = size;
+        if (fetch(lz, lo, to) == -1) return -1;
+        const char *m = search_pattern_find(pat, data + lo, to - lo);
+        if (m && (size_t)(m - data) < stop) return (long long)(m - data);
+        lo = stop;
+    }
+    return -1;
+}
+
+/* Offset of the last match of 'pat' starting in [lo, hi), or -1. Taken
+ * LAZY_FIND_CHUNK bytes at a time from 'hi' down, so a match near it is
+ * found without going over the bytes before. */
+static long long last_match(LazyFile *lz, const SearchPattern *pat,
+                            size_t lo, size_t hi) {
+    const char *data = lz->file.data;
+    size_t size = lz->file.size;
+    while (hi > lo) {
+        size_t from = hi - lo > LAZY_FIND_CHUNK ? hi - LAZY_FIND_CHUNK : lo;
+        size_t to = hi + (size_t)pat->len - 1;      /* Matches may end past hi */
+        if (to > size) to = size;
+        if (fetch(lz, from, to) == -1) return -1;
+        long long found = -1;
+        const char *m;
+        size_t at = from;
+        while (at < hi && (m = search_pattern_find(pat, data + at, to - at))) {
+            size_t off = (size_t)(m - data);
+            if (off >= hi) break;
+            found = (long long)off;
+            at = off + 1;
+        }
+        if (found >= 0) return found;
+        hi = from;
+    }
+    return -1;
+}
+
+/* The bytes a hex view query such as "7f 45 4c 46" or "cafe" stands for,
+ * into 'out'. Returns how many, or -1 if the query is not pairs of hex
+ * digits (spaces aside) or has more than 'max'. */
+static int hex_query(const char *query, int len, char *out, int max) {
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        if (query[i] == ' ') continue;
+        if (i + 1 >= len || !isxdigit((unsigned char)query[i]) ||
+            !isxdigit((unsigned char)query[i + 1]) || n == max)
+            return -1;
+        char pair[3] = {query[i], query[i + 1], 0};
+        out[n++] = (char)strtol(pair, NULL, 16);
+        i++;
+    }
+    return n > 0 ? n : -1;
+}
+
+int lazy_find(editor_ctx_t *ctx, const char *query, int len, int icase,
+              int from_row, int direction, int *col, int *cols) {
+    LazyFile *lz = ctx->model.lazy;
+    const char *data = lz->file.data;
+    size_t size = lz->file.size;
+    if (len == 0 || size == 0) return -1;
+
+    /* In hex view the query is bytes if it can be */
+    char bytes[LAZY_HEX_QUERY_MAX];
+    int nbytes = lz->hex ? hex_query(query, len, bytes, LAZY_HEX_QUERY_MAX) : -1;
+    SearchPattern pat;
+    if (nbytes > 0) search_pattern_init(&pat, bytes, nbytes);
+    else search_pattern_init_icase(&pat, query, len, icase);
+
+    /* The rows after (before) from_row: from the start of the window
+     * for -1 */
+    size_t at = lz->start;
+    if (from_row >= 0) at = row_offset(lz, from_row + (direction > 0));
+
+    long long found;
+    if (direction > 0) {
+        found = first_match(lz, &pat, at, size);
+        if (found < 0 && !lz->failed) found = first_match(lz, &pat, 0, at);
+    } else {
+        found = last_match(lz, &pat, 0, at);
+        if (found < 0 && !lz->failed) found = last_match(lz, &pat, at, size);
+    }
+    if (found < 0) {
+        report_failed(ctx, lz);
+        index_resume(lz);
+        return -1;
+    }
+
+    size_t off = (size_t)found;
+    size_t start = row_start(lz, off);
+    int row;
+    if (start >= lz->start && start < lz->end) {
+        row = lz->hex ? (int)((start - lz->start) / LAZY_HEX_BYTES) :
+              (int)loader_count_newlines(data, lz->start, start);
+    } else {
+        /* Outside the window: load the one around it, as :N% does */
+        size_t top = rows_above(lz, start, LAZY_WINDOW_ROWS / 2, &row);
+        load_window(ctx, top, top == 0 ? 0 : -1);
+    }
+
+    if (!lz->hex) {
+        *col = (int)(off - start);
+        *cols = pat.len;
+        return row;
+    }
+    /* Bytes are marked in hex, text in the characters, up to the end of
+     * the row */
+    int i = (int)(off - start);
+    int n = pat.len < LAZY_HEX_BYTES - i ? pat.len : LAZY_HEX_BYTES - i;
+    *col = nbytes > 0 ? hex_col(lz, i) : char_col(lz, i);
+    *cols = nbytes > 0 ? 3 * n - 1 : n;
+    return row;
+}
+
+size_t lazy_window(EditorModel *model) {
+    return model->lazy ? model->lazy->start : 0;
+}
+
+void lazy_return(editor_ctx_t *ctx, size_t start) {
+    LazyFile *lz = ctx->model.lazy;
+    if (lz == NULL || lz->start == start) return;
+    load_window(ctx, start, start == 0 ? 0 : -1);
+}
+
+int lazy_is_hex(const EditorModel *model) {
+    return model->lazy != NULL && model->lazy->hex;
+}
+
+/* Change byte 'off' of the mapping to 'b', noting its page changed */
+static int write_byte(editor_ctx_t *ctx, LazyFile *lz, size_t off, unsigned char b) {
+    /* The mapping is private: its pages are copied as they are written */
+    if (lz->file.mapped && !lz->writable &&
+        mprotect((void *)lz->file.data, lz->file.size, PROT_READ | PROT_WRITE) == -1) {
+        editor_set_status_msg(ctx, "Cannot change the bytes: %s", strerror(errno));
+        return -1;
+    }
+    lz->writable = 1;
+
+    size_t pages = (lz->file.size + LAZY_PAGE_BYTES - 1) / LAZY_PAGE_BYTES;
+    if (lz->dirty == NULL) {
+        lz->dirty = calloc((pages + 7) / 8, 1);
+        if (lz->dirty == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    size_t page = off / LAZY_PAGE_BYTES;
+    if (!(lz->dirty[page / 8] & (1 << page % 8))) {
+        lz->dirty[page / 8] |= (unsigned char)(1 << page % 8);
+        lz->ndirty++;
+    }
+    ((char *)lz->file.data)[off] = (char)b;
+    return 0;
+}
+
+int lazy_overwrite(editor_ctx_t *ctx, int c) {
+    LazyFile *lz = ctx->model.lazy;
+    if (lz == NULL || !lz->hex) return 0;
+    if (lz->remote) {
+        editor_set_status_msg(ctx, "Remote file: read-only");
+        return 1;
+    }
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    if (row >= ctx->model.numrows) return 1;
+
+    /* The byte under the cursor, and which of its digits */
+    int h = col - hex_col(lz, 0), i, digit = -1;
+    if (h >= 0 && h < 3 * LAZY_HEX_BYTES && h % 3 != 2) {
+        i = h / 3;
+        digit = h % 3;
+    } else if (col >= char_col(lz, 0) && col < char_col(lz, LAZY_HEX_BYTES)) {
+        i = col - char_col(lz, 0);
+    } else {
+        editor_set_status_msg(ctx, "Hex view: type over the hex digits or the characters");
+        return 1;
+    }
+    size_t at = lz->start + (size_t)row * LAZY_HEX_BYTES;
+    if (at + (size_t)i >= lz->file.size) return 1;
+
+    unsigned char b = (unsigned char)lz->file.data[at + (size_t)i];
+    if (digit >= 0) {
+        if (c > 0xff || !isxdigit(c)) {
+            editor_set_status_msg(ctx, "Hex view: not a hex digit");
+            return 1;
+        }
+        char pair[2] = {(char)c, 0};
+        int v = (int)strtol(pair, NULL, 16);
+        b = digit == 0 ? (unsigned char)((b & 0x0f) | v << 4) : (unsigned char)((b & 0xf0) | v);
+    } else if (c >= 0x20 && c < 0x7f) {
+        b = (unsigned char)c;
+    } else {
+        editor_set_status_msg(ctx, "Hex view: not a printable character");
+        return 1;
+    }
+    if (write_byte(ctx, lz, at + (size_t)i, b) == -1) return 1;
+
+    char buf[LAZY_HEX_ROW_MAX];
+    int len = hex_format(lz, at, buf);
+    editor_row_set(ctx, &ctx->model.row[row], buf, (size_t)len);
+
+    /* On to the next digit, or the next byte's */
+    if (digit == 0) col++;
+    else if (i + 1 < LAZY_HEX_BYTES) col = digit > 0 ? hex_col(lz, i + 1) : col + 1;
+    else if (row + 1 < ctx->model.numrows) {
+        row++;
+        col = digit > 0 ? hex_col(lz, 0) : char_col(lz, 0);
+    }
+    editor_cursor_to(ctx, row, col);
+    return 1;
+}
+
+/* Write the 'len' bytes at 'buf' at offset 'off' of 'fd' */
+static int write_at(int fd, const char *buf, size_t len, size_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        off += (size_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int lazy_save(editor_ctx_t *ctx) {
+    LazyFile *lz = ctx->model.lazy;
+    if (lz->remote) {
+        editor_set_status_msg(ctx, "Can't save! The file is remote");
+        return -1;
+    }
+    if (lz->file.compressed) {
+        editor_set_status_msg(ctx, "Can't save! The bytes shown were decompressed");
+        return -1;
+    }
+    int fd = open(ctx->model.filename, O_WRONLY);
+    if (fd == -1) {
+        editor_set_status_msg(ctx, "Can't save! I/O error: %s", strerror(errno));
+        return -1;
+    }
+
+    /* A run of changed pages goes in one write */
+    size_t size = lz->file.size, written = 0;
+    size_t pages = (size + LAZY_PAGE_BYTES - 1) / LAZY_PAGE_BYTES;
+    int failed = 0;
+    for (size_t p = 0; lz->dirty && p < pages && !failed; p++) {
+        if (!(lz->dirty[p / 8] & (1 << p % 8))) continue;
+        size_t q = p;
+        while (q + 1 < pages && lz->dirty[(q + 1) / 8] & (1 << (q + 1) % 8)) q++;
+        size_t from = p * LAZY_PAGE_BYTES, to = (q + 1) * LAZY_PAGE_BYTES;
+        if (to > size) to = size;
+        failed = write_at(fd, lz->file.data + from, to - from, from) == -1;
+        written += to - from;
+        p = q;
+    }
+    int saved = errno;
+    if (close(fd) == -1 && !failed) {
+        failed = 1;
+        saved = errno;
+    }
+    if (failed) {
+        editor_set_status_msg(ctx, "Can't save! I/O error: %s", strerror(saved));
+        return -1;
+    }
+
+    if (lz->dirty) memset(lz->dirty, 0, (pages + 7) / 8);
+    lz->ndirty = 0;
+    ctx->model.dirty = 0;
+    editor_set_status_msg(ctx, "%zu bytes written on disk (the pages changed)", written);
+    return 0;
+}
+
+void lazy_wait_index(EditorModel *model) {
+    LazyFile *lz = model->lazy;
+    if (lz == NULL || lz->hex) return;
+    if (lz->task) {
+        task_wait(lz->task);
+        lz->task = NULL;
+    }
+    while (index_slice(lz) == 0) {
+    }
+    atomic_store(&lz->idle, 1);
+}
@@ -0,0 +1,127 @@
+/* lazy.h - Files too large to load, shown a window of lines at a time
+ *
+ * editor_open() reads a file of lazy_min_bytes() or more this way. The
+ * mapping is kept, and the model holds the rows of one window of up to
+ * LAZY_WINDOW_ROWS lines of it: row i is line lazy_base() + i of the file.
+ * The window moves as the cursor nears one of its ends, and is loaded
+ * again from the mapping each time, so opening and moving cost the same
+ * whatever the size of the file.
+ *
+ * After open a LineCkpt of the mapping (see loader.h) is built on the task
+ * pool. :N loads the window at line N after a scan from the checkpoint
+ * before it (from the last one built, while the index is short of N); :N%
+ * loads it at a byte offset, with no scan at all, and its line numbers
+ * are shown once the index reaches it.
+ *
+ * The buffer is read-only: edits and saves are refused (see
+ * editor_refuse_edit()), so it keeps no undo history. editor_open_view()
+ * (--view, :view) opens a file this way whatever its size. Searches go
+ * over the mapping itself (lazy_find()), not just the window.
+ *
+ * Binary files, whatever their size, are shown the same way in hex: row i
+ * shows the LAZY_HEX_BYTES bytes at (lazy_base() + i) * LAZY_HEX_BYTES as
+ * offset, hex digits and characters, formatted as the window loads. Typing
+ * over a digit or character changes the byte in the mapping, which is
+ * private, so the kernel copies just the pages written; those are noted,
+ * and a save writes them back and nothing else. Bytes can be neither
+ * added nor removed, and changes are not undoable.
+ *
+ * ssh:// and http(s):// URLs are opened this way whatever their size, the
+ * mapping filled as it is read (see remote.h); they cannot be changed,
+ * even in hex.
+ */
+
+#ifndef LOKI_LAZY_H
+#define LOKI_LAZY_H
+
+#include "internal.h"
+#include "loader.h"
+
+/* editor_open() loads files of this many bytes or more lazily */
+#define LAZY_MIN_BYTES ((size_t)256 << 20)
+
+/* Lines in the window, and how close to an end of it (other than an end
+ * of the file) the cursor gets before it moves */
+#define LAZY_WINDOW_ROWS 4096
+#define LAZY_MARGIN_ROWS 512
+
+/* Bytes indexed between checks for a cancelled build */
+#define LAZY_INDEX_SLICE ((size_t)8 << 20)
+
+/* Bytes searched at a time by a backward lazy_find() */
+#define LAZY_FIND_CHUNK ((size_t)1 << 20)
+
+/* Hex view: bytes per row, the longest row (offsets of up to 16 digits),
+ * the most bytes a query stands for, and the pages changes are noted by */
+#define LAZY_HEX_BYTES 16
+#define LAZY_HEX_ROW_MAX 96
+#define LAZY_HEX_QUERY_MAX 128
+#define LAZY_PAGE_BYTES ((size_t)4096)
+
+typedef struct LazyFile LazyFile;
+
+/* Size from which files are loaded lazily. Setting it is for tests. */
+size_t lazy_min_bytes(void);
+void lazy_set_min_bytes(size_t bytes);
+
+/* Show 'file' in ctx a window at a time, taking it over: in hex if it is
+ * binary. Returns 0. */
+int lazy_open(editor_ctx_t *ctx, LoadedFile *file);
+
+/* Open the file at 'url' (see remote.h) this way, fetching the blocks
+ * the window and searches read. Returns 0, or -1 with a status message. */
+int lazy_open_remote(editor_ctx_t *ctx, const char *url);
+
+/* Stop indexing and release the file. Safe on a model loaded in full. */
+void lazy_close(EditorModel *model);
+
+/* Line of the file model row 0 shows: 0 for a model loaded in full, -1
+ * while the index has not reached a window loaded by :N%. */
+int lazy_base(EditorModel *model);
+
+/* Lines in the file, or -1 while it is being indexed. The model's rows
+ * for one loaded in full. */
+int lazy_lines(EditorModel *model);
+
+/* Load the window around line 'line' (0-based) and put the cursor on it.
+ * Returns the line reached: the last one if the file is shorter. */
+int lazy_goto(editor_ctx_t *ctx, int line);
+
+/* Load the window around the line 'percent' of the way into the file and
+ * put the cursor on it. */
+void lazy_goto_percent(editor_ctx_t *ctx, int percent);
+
+/* Move the window if the cursor is near an end of it that is not an end
+ * of the file. */
+void lazy_follow_cursor(editor_ctx_t *ctx);
+
+/* Find the 'len' bytes at 'query' (ignoring case if 'icase' is set) in
+ * the file, in the lines after model row 'from_row' (-1: from the top of
+ * the window), or before it if 'direction' is negative, wrapping around
+ * the file. In hex view a query of hex digit pairs ("7f 45 4c 46") is
+ * searched for as those bytes. A match outside the window loads the
+ * window around it. Returns the row of the match and sets *col and *cols
+ * to where in the row's chars it is shown, or returns -1. */
+int lazy_find(editor_ctx_t *ctx, const char *query, int len, int icase,
+              int from_row, int direction, int *col, int *cols);
+
+/* Is the model a binary file shown in hex? */
+int lazy_is_hex(const EditorModel *model);
+
+/* Hex view: type 'c' over the digit or character under the cursor and
+ * move on. Returns 1 if the model is in hex view (whether or not 'c'
+ * could be typed there), else 0. */
+int lazy_overwrite(editor_ctx_t *ctx, int c);
+
+/* Hex view: write the pages changed since the last save over the file's */
+int lazy_save(editor_ctx_t *ctx);
+
+/* Byte offset of the window in the file, and loading the window at such
+ * an offset again (say, when a search that moved it is cancelled) */
+size_t lazy_window(EditorModel *model);
+void lazy_return(editor_ctx_t *ctx, size_t start);
+
+/* Wait for the index to be built. For tests. */
+void lazy_wait_index(EditorModel *model);
+
+#endif /* LOKI_LAZY_H */
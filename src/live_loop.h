@@ -19,6 +19,7 @@ static inline int live_loop_is_active(editor_ctx_t *ctx) { (void)ctx; return 0;
 static inline int live_loop_is_active_buffer(int buffer_id) { (void)buffer_id; return 0; }
 static inline double live_loop_get_interval(editor_ctx_t *ctx) { (void)ctx; return 0.0; }
 static inline void live_loop_tick(void) {}
+static inline int live_loop_any_active(void) { return 0; }
 static inline void live_loop_shutdown(void) {}
 
 #endif /* LOKI_LIVE_LOOP_H */
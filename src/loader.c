@@ -0,0 +1,533 @@
+/* loader.c - File loading stage used by editor_open
+ *
+ * See loader.h for an overview. The file is mapped with mmap() where
+ * possible so that the line index can be built without copying the file,
+ * and rows are created from the mapping in a single pass.
+ */
+
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loader.h"
+#include "compress.h"
+
+/* Size of the prefix inspected by loader_is_binary() */
+#define LOADER_BINARY_PROBE 1024
+
+/* Initial capacity of the line index; grows by doubling */
+#define LOADER_INITIAL_LINES 1024
+
+/* Read a non-mappable file (pipe, character device) into a heap buffer. */
+static int read_into_heap(int fd, LoadedFile *file) {
+    size_t cap = 64 * 1024, len = 0;
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+
+    for (;;) {
+        if (len == cap) {
+            char *nbuf = realloc(buf, cap * 2);
+            if (!nbuf) {
+                free(buf);
+                return -1;
+            }
+            buf = nbuf;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        len += (size_t)n;
+    }
+
+    if (len == 0) {
+        free(buf);
+        buf = NULL;
+    }
+    file->data = buf;
+    file->size = len;
+    file->mapped = 0;
+    return 0;
+}
+
+/* Map 'path', or read it, as it is on disk */
+static int open_raw(const char *path, LoadedFile *file) {
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        int ret = read_into_heap(fd, file);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return ret;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        /* Some filesystems refuse mmap; fall back to reading. */
+        int ret = read_into_heap(fd, file);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return ret;
+    }
+    close(fd);
+
+    /* The loader walks the file once from start to end. */
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    file->data = map;
+    file->size = (size_t)st.st_size;
+    file->mapped = 1;
+    return 0;
+}
+
+int loader_open(const char *path, LoadedFile *file) {
+    if (open_raw(path, file) == -1) return -1;
+
+    /* A compressed file is loaded as what it decompresses to. One that
+     * fails to is loaded as it is. */
+    CompressFormat format = compress_detect(file->data, file->size);
+    if (format == COMPRESS_NONE || !compress_supported(format)) return 0;
+    char *text;
+    size_t len;
+    if (compress_inflate(format, file->data, file->size, &text, &len) == -1) return 0;
+    loader_close(file);
+    file->data = text;
+    file->size = len;
+    file->compressed = (int)format;
+    return 0;
+}
+
+void loader_close(LoadedFile *file) {
+    if (!file || !file->data) return;
+    if (file->mapped) {
+        munmap((void *)file->data, file->size);
+    } else {
+        free((void *)file->data);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+int loader_is_binary(const LoadedFile *file) {
+    if (!file || !file->data) return 0;
+    size_t probe = file->size < LOADER_BINARY_PROBE ? file->size : LOADER_BINARY_PROBE;
+    return memchr(file->data, '\0', probe) != NULL;
+}
+
+/* ======================= Line Index Scanner ============================ */
+
+/* The scanner classifies every byte of the file once. Each block of input
+ * (32 bytes with AVX2, 16 with SSE2, 8 in the portable word-at-a-time
+ * fallback) is turned into bitmasks of '\n', '\t' and NUL positions, so the
+ * per-byte work is a few vector compares instead of a branch per byte.
+ *
+ * Masks use one bit per byte for the vector paths. The word-at-a-time path
+ * produces masks with bit 7 of each byte set (an 0x80 "stride" of 8), so
+ * positions are always recovered as ctz(mask) / stride. */
+
+#if defined(__GNUC__) && !defined(LOADER_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LOADER_USE_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LOADER_USE_SSE2 1
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define loader_ctz64(x) __builtin_ctzll(x)
+#define loader_popcount64(x) __builtin_popcountll(x)
+#else
+static int loader_ctz64(uint64_t x) {
+    int n = 0;
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+}
+static int loader_popcount64(uint64_t x) {
+    int n = 0;
+    while (x) { x &= x - 1; n++; }
+    return n;
+}
+#endif
+
+typedef struct ScanState {
+    LineIndex *index;
+    int cap;
+    size_t line_start;   /* Offset of the line being scanned */
+    int line_tabs;       /* Tabs seen so far in that line */
+} ScanState;
+
+/* Append one line to the index, growing the arrays as needed. */
+static int index_push(ScanState *st, size_t start, size_t len, int tabs) {
+    LineIndex *index = st->index;
+    if (index->count == st->cap) {
+        int ncap = st->cap ? st->cap * 2 : LOADER_INITIAL_LINES;
+        size_t *nstart = realloc(index->start, sizeof(size_t) * ncap);
+        if (!nstart) return -1;
+        index->start = nstart;
+        int *nlen = realloc(index->len, sizeof(int) * ncap);
+        if (!nlen) return -1;
+        index->len = nlen;
+        int *ntabs = realloc(index->tabs, sizeof(int) * ncap);
+        if (!ntabs) return -1;
+        index->tabs = ntabs;
+        st->cap = ncap;
+    }
+    index->start[index->count] = start;
+    index->len[index->count] = (int)len;
+    index->tabs[index->count] = tabs;
+    index->count++;
+    return 0;
+}
+
+/* Close the current line at 'end' (offset of its '\n', or EOF). */
+static int end_line(ScanState *st, const char *data, size_t end) {
+    size_t len = end - st->line_start;
+
+    /* Strip trailing CRs, matching the old getline()-based reader. */
+    while (len > 0 && data[st->line_start + len - 1] == '\r') len--;
+
+    if (len > INT_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (index_push(st, st->line_start, len, st->line_tabs) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+    st->line_start = end + 1;
+    st->line_tabs = 0;
+    return 0;
+}
+
+/* Consume the newline/tab masks of one block starting at 'base'. */
+static int scan_block(ScanState *st, const char *data, size_t base,
+                      uint64_t nl, uint64_t tab, int stride) {
+    while (nl) {
+        int bit = loader_ctz64(nl);
+        uint64_t below = ((uint64_t)1 << bit) - 1;
+        st->line_tabs += loader_popcount64(tab & below);
+        tab &= ~below;
+        if (end_line(st, data, base + (size_t)(bit / stride)) == -1) return -1;
+        nl &= nl - 1;
+    }
+    st->line_tabs += loader_popcount64(tab);
+    return 0;
+}
+
+#if !defined(LOADER_USE_AVX2) && !defined(LOADER_USE_SSE2)
+/* Exact per-byte zero test: bit 7 of each byte is set iff the byte is 0. */
+static uint64_t word_zero_bytes(uint64_t x) {
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((x & low7) + low7) | x | low7);
+}
+#endif
+
+int loader_index_lines(const char *data, size_t size, LineIndex *index) {
+    ScanState st;
+    size_t pos = 0;
+
+    memset(index, 0, sizeof(*index));
+    memset(&st, 0, sizeof(st));
+    st.index = index;
+
+#if defined(LOADER_USE_AVX2)
+    const __m256i vnl = _mm256_set1_epi8('\n');
+    const __m256i vtab = _mm256_set1_epi8('\t');
+    const __m256i vzero = _mm256_setzero_si256();
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+        uint64_t nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vnl));
+        uint64_t tab = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vtab));
+        if (pos < LOADER_BINARY_PROBE &&
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vzero))) {
+            index->binary = 1;
+            goto found_binary;
+        }
+        if (scan_block(&st, data, pos, nl, tab, 1) == -1) goto fail;
+    }
+#elif defined(LOADER_USE_SSE2)
+    const __m128i vnl = _mm_set1_epi8('\n');
+    const __m128i vtab = _mm_set1_epi8('\t');
+    const __m128i vzero = _mm_setzero_si128();
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+        uint64_t nl = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl));
+        uint64_t tab = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vtab));
+        if (pos < LOADER_BINARY_PROBE &&
+            _mm_movemask_epi8(_mm_cmpeq_epi8(v, vzero))) {
+            index->binary = 1;
+            goto found_binary;
+        }
+        if (scan_block(&st, data, pos, nl, tab, 1) == -1) goto fail;
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t w;
+        memcpy(&w, data + pos, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        uint64_t nl = word_zero_bytes(w ^ (ones * '\n'));
+        uint64_t tab = word_zero_bytes(w ^ (ones * '\t'));
+        if (pos < LOADER_BINARY_PROBE && word_zero_bytes(w)) {
+            index->binary = 1;
+            goto found_binary;
+        }
+        if (scan_block(&st, data, pos, nl, tab, 8) == -1) goto fail;
+    }
+#endif
+
+    /* Scalar tail (and the whole input when it is shorter than a block). */
+    for (; pos < size; pos++) {
+        char c = data[pos];
+        if (c == '\n') {
+            if (end_line(&st, data, pos) == -1) goto fail;
+        } else if (c == '\t') {
+            st.line_tabs++;
+        } else if (c == '\0' && pos < LOADER_BINARY_PROBE) {
+            index->binary = 1;
+            goto found_binary;
+        }
+    }
+
+    /* Final line without a trailing newline. */
+    if (st.line_start < size) {
+        if (end_line(&st, data, size) == -1) goto fail;
+    }
+    return 0;
+
+found_binary:
+    /* Binary files are rejected by the caller; drop the partial index. */
+    free(index->start);
+    free(index->len);
+    free(index->tabs);
+    index->start = NULL;
+    index->len = NULL;
+    index->tabs = NULL;
+    index->count = 0;
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        loader_index_free(index);
+        errno = saved;
+    }
+    return -1;
+}
+
+void loader_index_free(LineIndex *index) {
+    if (!index) return;
+    free(index->start);
+    free(index->len);
+    free(index->tabs);
+    memset(index, 0, sizeof(*index));
+}
+
+/* ======================= Sparse Line Index ============================== */
+
+/* Bytes counted at a time while looking for the next checkpoint */
+#define LOADER_CKPT_SLICE 4096
+
+size_t loader_count_newlines(const char *data, size_t from, size_t to) {
+    size_t n = 0, pos = from;
+#if defined(LOADER_USE_AVX2)
+    const __m256i vnl = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= to; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+        n += (size_t)loader_popcount64(
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vnl)));
+    }
+#elif defined(LOADER_USE_SSE2)
+    const __m128i vnl = _mm_set1_epi8('\n');
+    for (; pos + 16 <= to; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+        n += (size_t)loader_popcount64(
+            (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl)));
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    for (; pos + 8 <= to; pos += 8) {
+        uint64_t w;
+        memcpy(&w, data + pos, 8);
+        n += (size_t)loader_popcount64(word_zero_bytes(w ^ (ones * '\n')));
+    }
+#endif
+    for (; pos < to; pos++) n += data[pos] == '\n';
+    return n;
+}
+
+size_t loader_skip_lines(const char *data, size_t size, size_t from, int n,
+                         int *skipped) {
+    int k = 0;
+    while (k < n && from < size) {
+        const char *nl = memchr(data + from, '\n', size - from);
+        if (!nl) break;
+        from = (size_t)(nl - data) + 1;
+        k++;
+    }
+    if (skipped) *skipped = k;
+    return from;
+}
+
+static size_t *ckpt_slot(const LineCkpt *ck, int k) {
+    return &ck->block[k / LOADER_CKPT_BLOCK][k % LOADER_CKPT_BLOCK];
+}
+
+int loader_ckpt_init(LineCkpt *ck, const char *data, size_t size) {
+    memset(ck, 0, sizeof(*ck));
+    ck->data = data;
+    ck->size = size;
+    /* Every line takes a byte at least, so checkpoint k is below size */
+    size_t nblocks = (size / LOADER_CKPT_LINES + 1) / LOADER_CKPT_BLOCK + 1;
+    if (nblocks > INT_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    ck->block = calloc(nblocks, sizeof(size_t *));
+    if (ck->block) ck->block[0] = malloc(sizeof(size_t) * LOADER_CKPT_BLOCK);
+    if (!ck->block || !ck->block[0]) {
+        free(ck->block);
+        ck->block = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    ck->nblocks = (int)nblocks;
+    ck->block[0][0] = 0;
+    atomic_init(&ck->count, 1);
+    atomic_init(&ck->done, 0);
+    return 0;
+}
+
+/* Write the next checkpoint, then make it visible to readers. */
+static int ckpt_publish(LineCkpt *ck, size_t off) {
+    int k = atomic_load_explicit(&ck->count, memory_order_relaxed);
+    if (k % LOADER_CKPT_BLOCK == 0) {
+        size_t *b = malloc(sizeof(size_t) * LOADER_CKPT_BLOCK);
+        if (!b) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ck->block[k / LOADER_CKPT_BLOCK] = b;
+    }
+    *ckpt_slot(ck, k) = off;
+    atomic_store_explicit(&ck->count, k + 1, memory_order_release);
+    return 0;
+}
+
+int loader_ckpt_build(LineCkpt *ck, size_t bytes) {
+    if (atomic_load(&ck->done)) return 1;
+    size_t end = bytes < ck->size - ck->pos ? ck->pos + bytes : ck->size;
+
+    while (ck->pos < end) {
+        size_t to = end - ck->pos > LOADER_CKPT_SLICE ?
+                    ck->pos + LOADER_CKPT_SLICE : end;
+        size_t n = loader_count_newlines(ck->data, ck->pos, to);
+        if (n > (size_t)(INT_MAX - 1 - ck->seen)) {
+            errno = EFBIG;
+            return -1;
+        }
+        int next = atomic_load_explicit(&ck->count, memory_order_relaxed) *
+                   LOADER_CKPT_LINES;
+        if (ck->seen + (int)n < next) {
+            ck->seen += (int)n;
+            ck->pos = to;
+            continue;
+        }
+        /* The line of the next checkpoint starts in this slice */
+        ck->pos = loader_skip_lines(ck->data, to, ck->pos, next - ck->seen, NULL);
+        ck->seen = next;
+        if (ck->pos < ck->size && ckpt_publish(ck, ck->pos) == -1) return -1;
+    }
+
+    if (ck->pos < ck->size) return 0;
+    ck->lines = ck->seen + (ck->size > 0 && ck->data[ck->size - 1] != '\n');
+    atomic_store(&ck->done, 1);
+    return 1;
+}
+
+int loader_ckpt_near(const LineCkpt *ck, int line, size_t *off) {
+    int count = atomic_load_explicit(&ck->count, memory_order_acquire);
+    int k = line / LOADER_CKPT_LINES;
+    if (k >= count) k = count - 1;
+    *off = *ckpt_slot(ck, k);
+    return k * LOADER_CKPT_LINES;
+}
+
+int loader_ckpt_seek(const LineCkpt *ck, int line, size_t *off) {
+    size_t from;
+    int base = loader_ckpt_near(ck, line, &from), skipped;
+    size_t at = loader_skip_lines(ck->data, ck->size, from, line - base, &skipped);
+    if (at < ck->size || skipped == 0) {
+        *off = at;
+        return base + skipped;
+    }
+    /* Past the final newline: back to the start of the last line */
+    size_t start = at - 1;
+    while (start > from && ck->data[start - 1] != '\n') start--;
+    *off = start;
+    return base + skipped - 1;
+}
+
+int loader_ckpt_line_of(const LineCkpt *ck, size_t off) {
+    int done = atomic_load(&ck->done);
+    int count = atomic_load_explicit(&ck->count, memory_order_acquire);
+    if (off > ck->size) off = ck->size;
+
+    /* The last checkpoint at or before 'off' */
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (*ckpt_slot(ck, mid) <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    if (lo == count - 1 && !done) return -1;
+    return lo * LOADER_CKPT_LINES +
+           (int)loader_count_newlines(ck->data, *ckpt_slot(ck, lo), off);
+}
+
+int loader_ckpt_lines(const LineCkpt *ck) {
+    return atomic_load(&ck->done) ? ck->lines : -1;
+}
+
+void loader_ckpt_free(LineCkpt *ck) {
+    if (!ck || !ck->block) return;
+    for (int b = 0; b < ck->nblocks; b++) free(ck->block[b]);
+    free(ck->block);
+    ck->block = NULL;
+    ck->nblocks = 0;
+}
@@ -0,0 +1,125 @@
+/* loader.h - File loading stage used by editor_open
+ *
+ * Splits file loading into two steps that do not touch editor state:
+ *
+ * 1. loader_open() maps the file read-only (falling back to a heap copy for
+ *    files that cannot be mapped, such as pipes), so reading a file costs
+ *    no per-line syscalls or getline() copies. A gzip or zstd file is
+ *    decompressed into a heap buffer instead (see compress.h).
+ * 2. loader_index_lines() scans the mapping once and produces a line-offset
+ *    index: start offset, length (CR/LF stripped) and tab count of every
+ *    line, plus the binary-file verdict. The scan runs 16 or 32 bytes at a
+ *    time with SSE2/AVX2 when available and 8 bytes at a time otherwise.
+ *
+ * editor_open() then creates rows straight from the mapping using the
+ * index. A model opened empty keeps the mapping and its rows use the lines
+ * where they are, each copied when first changed; otherwise rows are
+ * copies and the mapping is released with loader_close().
+ *
+ * Files too large to materialize (see lazy.h) get a sparse index instead:
+ * a LineCkpt holds the offset of every LOADER_CKPT_LINES-th line, built a
+ * slice at a time on a background thread, so reaching any line takes a
+ * scan of at most that many lines from the checkpoint before it.
+ */
+
+#ifndef LOKI_LOADER_H
+#define LOKI_LOADER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* A file's contents, either memory-mapped or read into a heap buffer. */
+typedef struct LoadedFile {
+    const char *data;   /* File contents (NULL for empty files) */
+    size_t size;        /* Size in bytes */
+    int mapped;         /* 1 if data is an mmap() region, 0 if heap */
+    int compressed;     /* The CompressFormat it was decompressed from */
+} LoadedFile;
+
+/* Line-offset index built by loader_index_lines(). */
+typedef struct LineIndex {
+    size_t *start;      /* Byte offset of each line in the file */
+    int *len;           /* Line length, excluding trailing CR/LF */
+    int *tabs;          /* Number of TAB bytes in each line */
+    int count;          /* Number of lines */
+    int binary;         /* 1 if a NUL byte was seen in the first 1KB */
+} LineIndex;
+
+/* Open and map a file.
+ * Returns 0 on success, -1 on error with errno set (ENOENT if missing). */
+int loader_open(const char *path, LoadedFile *file);
+
+/* Release a file opened with loader_open(). Safe on a zeroed struct. */
+void loader_close(LoadedFile *file);
+
+/* Check whether the file looks binary (NUL byte in the first 1KB).
+ * Returns 1 if binary, 0 otherwise. */
+int loader_is_binary(const LoadedFile *file);
+
+/* Build the line-offset index for a buffer.
+ * Lines are separated by '\n'; trailing '\r' and '\n' bytes are stripped
+ * from each line, and a final line without a newline is included.
+ * If the first 1KB contains a NUL byte the scan stops early with
+ * index->binary set and no lines indexed.
+ * Returns 0 on success, -1 on allocation failure or a line longer than
+ * INT_MAX bytes (errno set to ENOMEM or EFBIG). */
+int loader_index_lines(const char *data, size_t size, LineIndex *index);
+
+/* Free a line index. Safe on a zeroed struct. */
+void loader_index_free(LineIndex *index);
+
+/* Number of '\n' bytes in data[from..to). */
+size_t loader_count_newlines(const char *data, size_t from, size_t to);
+
+/* Offset just past the n-th '\n' at or after 'from' (n >= 0); with fewer
+ * before 'size', just past the last of them ('from' if none). Sets
+ * *skipped to the newlines passed. */
+size_t loader_skip_lines(const char *data, size_t size, size_t from, int n,
+                         int *skipped);
+
+/* Lines between checkpoints, and checkpoints per allocated block */
+#define LOADER_CKPT_LINES 1024
+#define LOADER_CKPT_BLOCK 4096
+
+/* Sparse line index. One thread builds it with loader_ckpt_build() while
+ * others look lines up: checkpoints are published through 'count' once
+ * written, and blocks are never moved. */
+typedef struct LineCkpt {
+    const char *data;
+    size_t size;
+    size_t **block;     /* block[k / BLOCK][k % BLOCK]: offset of line k * LINES */
+    int nblocks;        /* Block pointers, enough for the whole file */
+    atomic_int count;   /* Checkpoints published */
+    atomic_int done;    /* The whole file is indexed */
+    int lines;          /* Lines in the file, once done */
+    size_t pos;         /* Builder: bytes counted */
+    int seen;           /* Builder: newlines in them */
+} LineCkpt;
+
+/* Prepare an index of data[0..size). Returns 0, or -1 with errno ENOMEM. */
+int loader_ckpt_init(LineCkpt *ck, const char *data, size_t size);
+
+/* Index up to 'bytes' more of the data. Returns 1 once the whole file is
+ * indexed, 0 if there is more, -1 on allocation failure or more than
+ * INT_MAX lines (errno set). */
+int loader_ckpt_build(LineCkpt *ck, size_t bytes);
+
+/* The last checkpoint published at or before line 'line': returns its
+ * line, with *off its start. Reads no data. */
+int loader_ckpt_near(const LineCkpt *ck, int line, size_t *off);
+
+/* The start of line 'line' (0-based), scanning from the nearest checkpoint
+ * published before it. Returns the line reached, which is less than 'line'
+ * when the data ends first (then the last line), with *off its start. */
+int loader_ckpt_seek(const LineCkpt *ck, int line, size_t *off);
+
+/* The line data[off] is in, or -1 if the index does not reach it yet. */
+int loader_ckpt_line_of(const LineCkpt *ck, size_t off);
+
+/* Lines in the file, or -1 if the index is not done yet. */
+int loader_ckpt_lines(const LineCkpt *ck);
+
+/* Free an index. Safe on a zeroed struct. */
+void loader_ckpt_free(LineCkpt *ck);
+
+#endif /* LOKI_LOADER_H */
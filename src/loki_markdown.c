@@ -6,12 +6,17 @@
  * - Rendering markdown to HTML
  * - Rendering markdown to other formats (XML, LaTeX, etc.)
  * - Extracting document structure and metadata
+ * - Keeping the parsed document of a buffer up to date as it is edited
  */
 
 #include "loki_markdown.h"
 #include "internal.h"
 #include "loki/core.h"
+#include "task_pool.h"
 #include <cmark.h>
+#include <uv.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -206,6 +211,13 @@ int loki_markdown_count_links(loki_markdown_doc *doc) {
 
 /* ======================= Heading Extraction ================================ */
 
+/* Line (0-based) of the block 'node' is, or is in */
+static int node_row(cmark_node *node) {
+    while (node && cmark_node_get_type(node) >= CMARK_NODE_FIRST_INLINE)
+        node = cmark_node_parent(node);
+    return node ? cmark_node_get_start_line(node) - 1 : 0;
+}
+
 loki_markdown_heading *loki_markdown_extract_headings(loki_markdown_doc *doc, int *count) {
     if (!doc || !doc->root || !count) {
         if (count) {
@@ -239,6 +251,7 @@ loki_markdown_heading *loki_markdown_extract_headings(loki_markdown_doc *doc, in
             cmark_node_get_type(cur) == CMARK_NODE_HEADING) {
 
             headings[idx].level = cmark_node_get_heading_level(cur);
+            headings[idx].row = node_row(cur);
 
             /* Extract heading text from child nodes */
             cmark_node *child = cmark_node_first_child(cur);
@@ -308,6 +321,8 @@ loki_markdown_link *loki_markdown_extract_links(loki_markdown_doc *doc, int *cou
         if (ev_type == CMARK_EVENT_ENTER &&
             cmark_node_get_type(cur) == CMARK_NODE_LINK) {
 
+            links[idx].row = node_row(cur);
+
             /* Extract URL */
             const char *url = cmark_node_get_url(cur);
             if (url) {
@@ -380,3 +395,510 @@ int loki_markdown_validate(const char *text, size_t len) {
 
     return 0;
 }
+
+/* ======================= Buffer Cache ====================================== */
+
+/* A top-level block of the buffer. cmark's end lines are not exact (a
+ * block closed by the line after it may end there), so a block is taken
+ * to run from its start line to the last non-blank row before the next. */
+typedef struct {
+    int first, last;        /* Rows it spans */
+    cmark_node *node;       /* Its node, a child of the root */
+    char *html;             /* Rendered (NULL: not since it was parsed) */
+    size_t html_len;
+} md_block;
+
+struct loki_markdown_cache {
+    loki_markdown_doc doc;
+    md_block *blocks;
+    int nblocks, blocks_cap;
+    loki_markdown_heading *headings;
+    int nheadings, headings_cap;
+    loki_markdown_link *links;
+    int nlinks, links_cap;
+    int has_refs;           /* Some row may define a link reference */
+    int parsed_rows;        /* Rows fed to cmark by the last update */
+    unsigned long edits;    /* Row edits noted */
+
+    /* Rendering the blocks to HTML, maybe on the task pool */
+    int render_options;     /* Of the blocks' html */
+    int rendering;          /* render_task was submitted, not waited for */
+    atomic_int render_done;
+    Task *render_task;
+    char *render_out;       /* The HTML of the last render, not yet polled */
+    int rendered_blocks;    /* Blocks rendered by the last render */
+
+    /* Rows d0..d1, as last parsed, are now rows d0..d1+delta */
+    int dirty, d0, d1, delta;
+};
+
+static void *md_grow(void *p, int *cap, int need, size_t size) {
+    if (need <= *cap) return p;
+    int cap2 = *cap ? *cap : 16;
+    while (cap2 < need) cap2 *= 2;
+    p = realloc(p, size * (size_t)cap2);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *cap = cap2;
+    return p;
+}
+
+/* Replace items from..to-1 of the array at *p (of *n items of 'size'
+ * bytes) by the 'm' items at 'items' */
+static void md_splice(void *p, int *n, int *cap, size_t size, int from, int to,
+                      const void *items, int m) {
+    char **arr = p;
+    *arr = md_grow(*arr, cap, *n - (to - from) + m, size);
+    if (*n > to)
+        memmove(*arr + (size_t)(from + m) * size, *arr + (size_t)to * size,
+                (size_t)(*n - to) * size);
+    if (m) memcpy(*arr + (size_t)from * size, items, (size_t)m * size);
+    *n += m - (to - from);
+}
+
+static int row_blank(const EditorModel *model, int r) {
+    const t_erow *row = &model->row[r];
+    for (int i = 0; i < row->size; i++)
+        if (row->chars[i] != ' ' && row->chars[i] != '\t' && row->chars[i] != '\r') return 0;
+    return 1;
+}
+
+/* Could row 'r' be (part of) a link reference definition? */
+static int row_has_ref(const EditorModel *model, int r) {
+    const t_erow *row = &model->row[r];
+    for (int i = 0; i + 1 < row->size; i++)
+        if (row->chars[i] == ']' && row->chars[i + 1] == ':') return 1;
+    return 0;
+}
+
+/* Can the block run on past a blank line, into what follows? */
+static int block_spans_blanks(cmark_node *node) {
+    cmark_node_type type = cmark_node_get_type(node);
+    return type == CMARK_NODE_LIST || type == CMARK_NODE_CODE_BLOCK ||
+           type == CMARK_NODE_HTML_BLOCK;
+}
+
+/* Parse rows first..last on their own, a row at a time */
+static cmark_node *parse_rows(loki_markdown_cache *cache, const EditorModel *model,
+                              int first, int last) {
+    cmark_parser *parser = cmark_parser_new(cache->doc.options);
+    for (int r = first; r <= last; r++) {
+        cmark_parser_feed(parser, model->row[r].chars, (size_t)model->row[r].size);
+        cmark_parser_feed(parser, "\n", 1);
+    }
+    cmark_node *root = cmark_parser_finish(parser);
+    cmark_parser_free(parser);
+    cache->parsed_rows += last - first + 1;
+    return root;
+}
+
+/* The text of an inline tree, its breaks as spaces (malloc'ed) */
+static char *node_text(cmark_node *node) {
+    size_t len = 0, cap = 64;
+    char *text = malloc(cap);
+    if (text == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    cmark_iter *iter = cmark_iter_new(node);
+    cmark_event_type ev;
+    while ((ev = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        cmark_node *cur = cmark_iter_get_node(iter);
+        if (ev != CMARK_EVENT_ENTER) continue;
+        cmark_node_type type = cmark_node_get_type(cur);
+        const char *s = type == CMARK_NODE_TEXT || type == CMARK_NODE_CODE
+                        ? cmark_node_get_literal(cur)
+                        : type == CMARK_NODE_SOFTBREAK || type == CMARK_NODE_LINEBREAK
+                        ? " " : NULL;
+        size_t n = s ? strlen(s) : 0;
+        if (len + n + 1 > cap) {
+            while (len + n + 1 > cap) cap *= 2;
+            text = realloc(text, cap);
+            if (text == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+        }
+        if (n) memcpy(text + len, s, n);
+        len += n;
+    }
+    cmark_iter_free(iter);
+    text[len] = '\0';
+    return text;
+}
+
+/* The index entries of the tree at 'node', a top-level block starting at
+ * row 'row', appended to heads and links */
+static void index_block(cmark_node *node, int row,
+                        loki_markdown_heading **heads, int *nheads, int *heads_cap,
+                        loki_markdown_link **links, int *nlinks, int *links_cap) {
+    int base = row - (cmark_node_get_start_line(node) - 1);
+    cmark_iter *iter = cmark_iter_new(node);
+    cmark_event_type ev;
+    while ((ev = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        cmark_node *cur = cmark_iter_get_node(iter);
+        if (ev != CMARK_EVENT_ENTER) continue;
+        cmark_node_type type = cmark_node_get_type(cur);
+        if (type == CMARK_NODE_HEADING) {
+            *heads = md_grow(*heads, heads_cap, *nheads + 1, sizeof(**heads));
+            loki_markdown_heading *h = &(*heads)[(*nheads)++];
+            h->level = cmark_node_get_heading_level(cur);
+            h->text = node_text(cur);
+            h->row = base + node_row(cur);
+        } else if (type == CMARK_NODE_LINK) {
+            *links = md_grow(*links, links_cap, *nlinks + 1, sizeof(**links));
+            loki_markdown_link *l = &(*links)[(*nlinks)++];
+            const char *url = cmark_node_get_url(cur);
+            const char *title = cmark_node_get_title(cur);
+            l->url = url ? strdup(url) : NULL;
+            l->title = title && title[0] ? strdup(title) : NULL;
+            l->text = node_text(cur);
+            l->row = base + node_row(cur);
+        }
+    }
+    cmark_iter_free(iter);
+}
+
+static void cache_clear(loki_markdown_cache *cache) {
+    for (int i = 0; i < cache->nblocks; i++) free(cache->blocks[i].html);
+    if (cache->doc.root) cmark_node_free(cache->doc.root);
+    cache->doc.root = NULL;
+    cache->nblocks = 0;
+    for (int i = 0; i < cache->nheadings; i++) free(cache->headings[i].text);
+    cache->nheadings = 0;
+    for (int i = 0; i < cache->nlinks; i++) {
+        free(cache->links[i].url);
+        free(cache->links[i].title);
+        free(cache->links[i].text);
+    }
+    cache->nlinks = 0;
+}
+
+/* Replace the blocks from..to-1, spanning rows s..e as last parsed, by the
+ * children of 'doc', parsed from rows s..e+delta; what follows moves by
+ * 'delta' rows */
+static void cache_splice(loki_markdown_cache *cache, const EditorModel *model,
+                         int from, int to, int s, int e, int delta, cmark_node *doc) {
+    cmark_node *anchor = to < cache->nblocks ? cache->blocks[to].node : NULL;
+    for (int i = from; i < to; i++) {
+        cmark_node_free(cache->blocks[i].node);
+        free(cache->blocks[i].html);
+    }
+
+    md_block *blocks = NULL;
+    int n = 0, cap = 0;
+    loki_markdown_heading *heads = NULL;
+    int nheads = 0, heads_cap = 0;
+    loki_markdown_link *links = NULL;
+    int nlinks = 0, links_cap = 0;
+    for (cmark_node *c = cmark_node_first_child(doc), *next; c; c = next) {
+        next = cmark_node_next(c);
+        blocks = md_grow(blocks, &cap, n + 1, sizeof(*blocks));
+        blocks[n].first = s + cmark_node_get_start_line(c) - 1;
+        blocks[n].node = c;
+        blocks[n].html = NULL;
+        blocks[n].html_len = 0;
+        index_block(c, blocks[n].first, &heads, &nheads, &heads_cap,
+                    &links, &nlinks, &links_cap);
+        n++;
+        cmark_node_unlink(c);
+        if (anchor) cmark_node_insert_before(anchor, c);
+        else cmark_node_append_child(cache->doc.root, c);
+    }
+    cmark_node_free(doc);
+    for (int i = 0; i < n; i++) {
+        int last = (i + 1 < n ? blocks[i + 1].first : e + delta + 1) - 1;
+        while (last > blocks[i].first && row_blank(model, last)) last--;
+        blocks[i].last = last;
+    }
+
+    md_splice(&cache->blocks, &cache->nblocks, &cache->blocks_cap, sizeof(*blocks),
+              from, to, blocks, n);
+    for (int i = from + n; i < cache->nblocks; i++) {
+        cache->blocks[i].first += delta;
+        cache->blocks[i].last += delta;
+    }
+
+    /* The index entries of rows s..e go, those below move */
+    int lo = 0, hi;
+    while (lo < cache->nheadings && cache->headings[lo].row < s) lo++;
+    for (hi = lo; hi < cache->nheadings && cache->headings[hi].row <= e; hi++)
+        free(cache->headings[hi].text);
+    for (int i = hi; i < cache->nheadings; i++) cache->headings[i].row += delta;
+    md_splice(&cache->headings, &cache->nheadings, &cache->headings_cap,
+              sizeof(*heads), lo, hi, heads, nheads);
+
+    lo = 0;
+    while (lo < cache->nlinks && cache->links[lo].row < s) lo++;
+    for (hi = lo; hi < cache->nlinks && cache->links[hi].row <= e; hi++) {
+        free(cache->links[hi].url);
+        free(cache->links[hi].title);
+        free(cache->links[hi].text);
+    }
+    for (int i = hi; i < cache->nlinks; i++) cache->links[i].row += delta;
+    md_splice(&cache->links, &cache->nlinks, &cache->links_cap,
+              sizeof(*links), lo, hi, links, nlinks);
+
+    free(blocks);
+    free(heads);
+    free(links);
+}
+
+/* Parse the whole buffer */
+static void cache_rebuild(loki_markdown_cache *cache, const EditorModel *model) {
+    cache_clear(cache);
+    cache->has_refs = 0;
+    for (int r = 0; r < model->numrows && !cache->has_refs; r++)
+        cache->has_refs = row_has_ref(model, r);
+    cache->doc.root = cmark_node_new(CMARK_NODE_DOCUMENT);
+    cache_splice(cache, model, 0, 0, 0, model->numrows - 1, 0,
+                 parse_rows(cache, model, 0, model->numrows - 1));
+}
+
+/* Index of the first block ending at 'row' or after it */
+static int block_find(const loki_markdown_cache *cache, int row) {
+    int lo = 0, hi = cache->nblocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cache->blocks[mid].last < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Reparse the blocks the edited window touches */
+static void cache_update(loki_markdown_cache *cache, const EditorModel *model) {
+    int d0 = cache->d0, d1 = cache->d1, delta = cache->delta;
+    int numrows = model->numrows, nb = cache->nblocks;
+    int old_numrows = numrows - delta;
+    if (cache->has_refs || d0 < 0 || d1 + delta >= numrows || d1 >= old_numrows) {
+        cache_rebuild(cache, model);
+        return;
+    }
+
+    /* Blocks i0..i1 are reparsed: those in the window or next to it,
+     * widening (by more each time) until it is bounded by blank lines
+     * that no block outside runs over */
+    int i0 = block_find(cache, d0 - 1);
+    int i1 = block_find(cache, d1 + 2) - 1;
+    if (i1 < nb - 1 && cache->blocks[i1 + 1].first <= d1 + 1) i1++;
+    int step = 1;
+    cmark_node *doc;
+    int s, e;
+    for (;;) {
+        s = i0 <= 0 ? 0 : d0;
+        e = i1 >= nb - 1 ? old_numrows - 1 : d1;
+        if (i0 > 0 && i0 <= i1 && cache->blocks[i0].first < s) s = cache->blocks[i0].first;
+        if (i1 < nb - 1 && i0 <= i1 && cache->blocks[i1].last > e) e = cache->blocks[i1].last;
+
+        if (s > 0 && (!row_blank(model, s - 1) || block_spans_blanks(cache->blocks[i0 - 1].node))) {
+            i0 = i0 - step < 0 ? 0 : i0 - step;
+            step *= 2;
+            continue;
+        }
+        if (e + delta < numrows - 1 && !row_blank(model, e + delta + 1)) {
+            i1 = i1 + step > nb - 1 ? nb - 1 : i1 + step;
+            step *= 2;
+            continue;
+        }
+        for (int r = s; r <= e + delta; r++) {
+            if (row_has_ref(model, r)) {
+                cache_rebuild(cache, model);
+                return;
+            }
+        }
+        doc = parse_rows(cache, model, s, e + delta);
+        cmark_node *last = cmark_node_last_child(doc);
+        if (last && e + delta < numrows - 1 && block_spans_blanks(last)) {
+            cmark_node_free(doc);
+            i1 = i1 + step > nb - 1 ? nb - 1 : i1 + step;
+            step *= 2;
+            continue;
+        }
+        break;
+    }
+    cache_splice(cache, model, i0, i1 + 1, s, e, delta, doc);
+}
+
+static void render_wait(loki_markdown_cache *cache) {
+    if (!cache->rendering) return;
+    task_wait(cache->render_task);
+    cache->render_task = NULL;
+    cache->rendering = 0;
+}
+
+loki_markdown_cache *loki_markdown_cache_get(EditorModel *model, int options) {
+    loki_markdown_cache *cache = model->md_cache;
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        cache->doc.options = options;
+        model->md_cache = cache;
+        cache_rebuild(cache, model);
+        return cache;
+    }
+    render_wait(cache);         /* It reads the blocks */
+    cache->parsed_rows = 0;
+    if (cache->doc.options != options) {
+        cache->doc.options = options;
+        cache_rebuild(cache, model);
+    } else if (cache->dirty) {
+        cache_update(cache, model);
+    }
+    cache->dirty = 0;
+    return cache;
+}
+
+loki_markdown_doc *loki_markdown_cache_doc(loki_markdown_cache *cache) {
+    return &cache->doc;
+}
+
+const loki_markdown_heading *loki_markdown_cache_headings(loki_markdown_cache *cache, int *count) {
+    *count = cache->nheadings;
+    return cache->headings;
+}
+
+const loki_markdown_link *loki_markdown_cache_links(loki_markdown_cache *cache, int *count) {
+    *count = cache->nlinks;
+    return cache->links;
+}
+
+int loki_markdown_cache_parsed_rows(loki_markdown_cache *cache) {
+    return cache->parsed_rows;
+}
+
+unsigned long loki_markdown_cache_edits(const EditorModel *model) {
+    return model->md_cache ? model->md_cache->edits : 0;
+}
+
+/* Render the blocks that have no HTML, and join all of it in render_out */
+static void render_blocks(loki_markdown_cache *cache) {
+    size_t len = 0;
+    cache->rendered_blocks = 0;
+    for (int i = 0; i < cache->nblocks; i++) {
+        md_block *b = &cache->blocks[i];
+        if (b->html == NULL) {
+            b->html = cmark_render_html(b->node, cache->render_options);
+            b->html_len = strlen(b->html);
+            cache->rendered_blocks++;
+        }
+        len += b->html_len;
+    }
+    char *out = malloc(len + 1);
+    if (out == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    len = 0;
+    for (int i = 0; i < cache->nblocks; i++) {
+        memcpy(out + len, cache->blocks[i].html, cache->blocks[i].html_len);
+        len += cache->blocks[i].html_len;
+    }
+    out[len] = '\0';
+    free(cache->render_out);
+    cache->render_out = out;
+}
+
+static void render_main(void *arg) {
+    loki_markdown_cache *cache = arg;
+    render_blocks(cache);
+    atomic_store(&cache->render_done, 1);
+}
+
+/* Blocks rendered with other options are rendered again */
+static void render_set_options(loki_markdown_cache *cache, int options) {
+    if (cache->render_options == options) return;
+    for (int i = 0; i < cache->nblocks; i++) {
+        free(cache->blocks[i].html);
+        cache->blocks[i].html = NULL;
+    }
+    cache->render_options = options;
+}
+
+char *loki_markdown_cache_render_html(loki_markdown_cache *cache, int options) {
+    render_wait(cache);
+    render_set_options(cache, options);
+    render_blocks(cache);
+    char *html = cache->render_out;
+    cache->render_out = NULL;
+    return html;
+}
+
+int loki_markdown_cache_render_start(loki_markdown_cache *cache, int options) {
+    if (cache->rendering) return -1;
+    render_set_options(cache, options);
+    atomic_store(&cache->render_done, 0);
+    cache->render_task = task_submit(render_main, cache, TASK_PRIORITY_NORMAL, NULL);
+    if (cache->render_task == NULL) {
+        render_blocks(cache);       /* No thread: render it here */
+        return 0;
+    }
+    cache->rendering = 1;
+    return 0;
+}
+
+int loki_markdown_cache_render_poll(loki_markdown_cache *cache, char **html) {
+    if (cache->rendering) {
+        if (!atomic_load(&cache->render_done)) return 0;
+        render_wait(cache);
+    }
+    if (cache->render_out == NULL) return -1;
+    *html = cache->render_out;
+    cache->render_out = NULL;
+    return 1;
+}
+
+void loki_markdown_cache_render_wait(loki_markdown_cache *cache) {
+    render_wait(cache);
+}
+
+int loki_markdown_cache_rendered_blocks(loki_markdown_cache *cache) {
+    return cache->rendered_blocks;
+}
+
+/* Rows lo..hi, as they are now, changed; then 'delta' rows came or went */
+static void note_rows(EditorModel *model, int lo, int hi, int delta) {
+    loki_markdown_cache *cache = model->md_cache;
+    if (cache == NULL) return;
+    if (!cache->dirty) {
+        cache->dirty = 1;
+        cache->d0 = lo;
+        cache->d1 = hi;
+        cache->delta = 0;
+    } else {
+        if (lo < cache->d0) cache->d0 = lo;
+        if (hi > cache->d1 + cache->delta) cache->d1 = hi - cache->delta;
+    }
+    cache->delta += delta;
+    cache->edits++;
+}
+
+void loki_markdown_cache_note_insert(EditorModel *model, int at) {
+    note_rows(model, at, at - 1, 1);
+}
+
+void loki_markdown_cache_note_delete(EditorModel *model, int at) {
+    note_rows(model, at, at, -1);
+}
+
+void loki_markdown_cache_note_change(EditorModel *model, int at) {
+    note_rows(model, at, at, 0);
+}
+
+void loki_markdown_cache_free(EditorModel *model) {
+    loki_markdown_cache *cache = model->md_cache;
+    if (cache == NULL) return;
+    render_wait(cache);
+    free(cache->render_out);
+    cache_clear(cache);
+    free(cache->blocks);
+    free(cache->headings);
+    free(cache->links);
+    free(cache);
+    model->md_cache = NULL;
+}
@@ -1,7 +1,9 @@
 /* loki_markdown.h - Markdown parsing and rendering API
  *
  * This header provides the public API for markdown parsing and rendering
- * using the cmark library (CommonMark specification).
+ * using the cmark library (CommonMark specification), and the per-buffer
+ * Markdown cache: the AST of a buffer, and its headings and links, kept
+ * up to date as it is edited by reparsing only the blocks edits touch.
  */
 
 #ifndef LOKI_MARKDOWN_H
@@ -10,6 +12,8 @@
 #include <stddef.h>
 #include <cmark.h>
 
+struct EditorModel;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -26,6 +30,7 @@ typedef struct loki_markdown_doc {
 typedef struct loki_markdown_heading {
     int level;           /* Heading level (1-6) */
     char *text;          /* Heading text content */
+    int row;             /* Line it starts on (0-based) */
 } loki_markdown_heading;
 
 /* Link information */
@@ -33,6 +38,7 @@ typedef struct loki_markdown_link {
     char *url;           /* Link URL */
     char *title;         /* Link title (may be NULL) */
     char *text;          /* Link text content */
+    int row;             /* Line of the block it is in (0-based) */
 } loki_markdown_link;
 
 /* ======================= Parse Options ==================================== */
@@ -238,6 +244,73 @@ loki_markdown_link *loki_markdown_extract_links(loki_markdown_doc *doc, int *cou
  */
 void loki_markdown_free_links(loki_markdown_link *links, int count);
 
+/* ======================= Buffer Cache ===================================== */
+
+/* The Markdown of a buffer, parsed once and then kept up to date: its
+ * top-level blocks are kept with the rows they span, and row edits (see
+ * loki_markdown_cache_note_*()) mark a window of rows. The next
+ * loki_markdown_cache_get() reparses only the blocks in and next to the
+ * window, fed row by row to cmark's streaming parser, and splices them
+ * into the AST and the heading and link indexes.
+ *
+ * A window is widened until it starts and ends at blank lines between
+ * blocks that cannot run over them (lists, code and HTML blocks can), so
+ * the blocks outside it parse as they did. A buffer with link reference
+ * definitions (a "]:" on any row) is parsed in full, as they change links
+ * anywhere. */
+typedef struct loki_markdown_cache loki_markdown_cache;
+
+/* The cache of 'model', made on first use and brought up to date with
+ * 'options' (LOKI_MD_OPT_*; other options than last time reparse it all).
+ * Owned by the model, and valid until its rows next change. */
+loki_markdown_cache *loki_markdown_cache_get(struct EditorModel *model, int options);
+
+/* The cached document, for the render, count and extraction functions.
+ * Owned by the cache: do not free it. Source positions of its nodes are
+ * relative to the block they are in; the index entries carry rows. */
+loki_markdown_doc *loki_markdown_cache_doc(loki_markdown_cache *cache);
+
+/* The headings, and links, of the buffer in row order. Owned by the cache. */
+const loki_markdown_heading *loki_markdown_cache_headings(loki_markdown_cache *cache, int *count);
+const loki_markdown_link *loki_markdown_cache_links(loki_markdown_cache *cache, int *count);
+
+/* Rows fed to cmark by the last update of the cache. For tests. */
+int loki_markdown_cache_parsed_rows(loki_markdown_cache *cache);
+
+/* Row edits noted by the cache of 'model' so far (0 without one): a
+ * change in it means the document is due for an update */
+unsigned long loki_markdown_cache_edits(const struct EditorModel *model);
+
+/* Render the cached document to HTML: only the blocks reparsed since the
+ * last render (or rendered with other options) are rendered again, and
+ * the HTML of every block is joined. Returns it malloc'ed, to free. */
+char *loki_markdown_cache_render_html(loki_markdown_cache *cache, int options);
+
+/* The same on a thread of its own. Until it is done the cache must not
+ * be used but through loki_markdown_cache_get() and _free(), which wait
+ * for it, and loki_markdown_cache_render_poll(). Returns -1 if a render
+ * is already running. */
+int loki_markdown_cache_render_start(loki_markdown_cache *cache, int options);
+
+/* Once the render started is done, its HTML goes to *html (malloc'ed, to
+ * free) and 1 is returned; 0 while it runs, -1 if none was started. */
+int loki_markdown_cache_render_poll(loki_markdown_cache *cache, char **html);
+
+/* Wait for the render started to be done (its HTML is left to poll) */
+void loki_markdown_cache_render_wait(loki_markdown_cache *cache);
+
+/* Blocks rendered by the last render. For tests. */
+int loki_markdown_cache_rendered_blocks(loki_markdown_cache *cache);
+
+/* Tell the cache (if the model has one) that row 'at' was inserted,
+ * deleted or changed. */
+void loki_markdown_cache_note_insert(struct EditorModel *model, int at);
+void loki_markdown_cache_note_delete(struct EditorModel *model, int at);
+void loki_markdown_cache_note_change(struct EditorModel *model, int at);
+
+/* Drop the cache of 'model' */
+void loki_markdown_cache_free(struct EditorModel *model);
+
 /* ======================= Utility Functions ================================ */
 
 /* Get cmark library version string
@@ -0,0 +1,1219 @@
+/* lsp.c - Language Server Protocol client
+ *
+ * See lsp.h for an overview. A client is one server process; each
+ * buffer attached to it is an LspDoc, reached from its model. Whatever
+ * the server writes is cut into messages by their Content-Length headers
+ * as it is read, each message's body fed to the client's json_stream,
+ * and the messages kept go onto the client's inbox. Nothing the server
+ * sends is acted on from the read callback: lsp_tick() handles the inbox,
+ * then sends the edits and requests that are due.
+ *
+ * The changed rows of a document are a sorted list of spans in the
+ * buffer's present rows, neither overlapping nor touching, each knowing
+ * how many rows it replaced of the text the server has. Sent top to
+ * bottom, each change lands where its span starts, the ones above it
+ * having been applied. The server's text is the rows, each followed by a
+ * newline; an edit at the end of the buffer may count a row past it on
+ * both sides, which the changes leave out.
+ */
+
+#define _DEFAULT_SOURCE     /* realpath(), strdup() */
+
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "lsp.h"
+#include "decor.h"
+#include "json.h"
+#include "json_stream.h"
+
+/* Bytes asked of the loop per read */
+#define LSP_READ_CHUNK ((size_t)64 << 10)
+
+/* Header bytes of a message, at most */
+#define LSP_HEADER_MAX 1024
+
+/* Body bytes of a message, at most */
+#define LSP_MESSAGE_MAX ((size_t)256 << 20)
+
+/* A server asked to shut down is killed if it has not exited by then */
+#define LSP_STOP_MS 2000
+
+/* Kinds of the client's own requests, after LSP_REQ_* */
+#define REQ_INITIALIZE LSP_REQ_KINDS
+#define REQ_SHUTDOWN   (LSP_REQ_KINDS + 1)
+
+typedef struct LspClient LspClient;
+
+/* Rows first..last of the buffer, which replaced old_count rows of the
+ * server's text */
+typedef struct {
+    int first, last;
+    int old_count;
+} LspSpan;
+
+/* A request sent and not answered */
+typedef struct LspRequest {
+    int id;
+    int kind;               /* LSP_REQ_* or REQ_* */
+    LspDoc *doc;            /* NULL once cancelled: the answer is skipped */
+    LspResultFn fn;
+    void *opaque;
+    struct LspRequest *next;
+} LspRequest;
+
+/* A request waiting out LSP_DEBOUNCE_MS */
+typedef struct {
+    LspResultFn fn;         /* NULL: none */
+    void *opaque;
+    int row, col;
+    uint64_t due;
+} LspPending;
+
+struct LspDoc {
+    editor_ctx_t *ctx;
+    LspClient *client;
+    LspDoc *next;           /* The client's documents */
+    char *uri;              /* NULL until opened in the server */
+    int version;
+    int rows;               /* Rows of the server's text */
+    int full;               /* Send the whole text next */
+    LspSpan spans[LSP_MAX_SPANS];
+    int nspans;
+    uint64_t sync_due;      /* When edits go (0: none waiting) */
+    LspPending pending[LSP_REQ_KINDS];
+    LspRequest *sent[LSP_REQ_KINDS];
+    LspDiagnostic *diags;
+    int ndiags;
+};
+
+/* A message read, waiting for lsp_tick() */
+typedef struct LspMessage {
+    int has_id;
+    int id;                 /* If a number */
+    char *id_string;        /* If a string (never one of ours) */
+    char *method;           /* NULL for a response */
+    int error;              /* A response with an error */
+    char *body;             /* Its result or params, if kept */
+    size_t body_len;
+    struct LspMessage *next;
+} LspMessage;
+
+struct LspClient {
+    char *cmd;
+    LspClient *next;        /* Running clients */
+    uv_process_t proc;      /* The handles' data is the LspClient */
+    uv_pipe_t in, out;
+    int open;               /* Handles not closed yet */
+    int exited;
+    int closing;            /* Off the list: freed once its handles close */
+    int ready;              /* initialize answered */
+    int utf8;               /* Positions in bytes, not UTF-16 code units */
+    int sync;               /* textDocumentSync: 0 none, 1 full, 2 incremental */
+    uint64_t stop_at;       /* Asked to shut down: killed then (0: running) */
+    int next_id;
+    LspDoc *docs;
+    LspRequest *requests;
+    LspMessage *inbox, **inbox_tail;
+
+    /* Reading */
+    char *rbuf;
+    char header[LSP_HEADER_MAX];
+    size_t header_len;
+    int in_body;
+    size_t body_left;
+    LspMessage *cur;        /* Being read (NULL: dropped) */
+    JsonStream *js;
+    int bad;                /* Not JSON-RPC: the rest is ignored */
+};
+
+static LspClient *clients;
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (!p) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    char *p = strdup(s);
+    if (!p) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+/* ============================ Positions ================================= */
+
+/* UTF-16 code units in the first 'col' bytes of a row */
+static int utf16_col(const t_erow *row, int col) {
+    int units = 0;
+    for (int i = 0; i < col && i < row->size; i++) {
+        unsigned char b = (unsigned char)row->chars[i];
+        if ((b & 0xC0) != 0x80) units += b >= 0xF0 ? 2 : 1;
+    }
+    return units;
+}
+
+/* Bytes of a row that 'units' UTF-16 code units take */
+static int byte_col(const t_erow *row, int units) {
+    int i = 0;
+    while (i < row->size && units > 0) {
+        units -= (unsigned char)row->chars[i] >= 0xF0 ? 2 : 1;
+        i++;
+        while (i < row->size && ((unsigned char)row->chars[i] & 0xC0) == 0x80) i++;
+    }
+    return i;
+}
+
+/* The byte column of a position the server sent, within the row */
+static int from_character(const LspClient *c, const EditorModel *model,
+                          int row, int character) {
+    if (row < 0 || row >= model->numrows || character <= 0) return 0;
+    const t_erow *r = &model->row[row];
+    if (c->utf8) return character < r->size ? character : r->size;
+    return byte_col(r, character);
+}
+
+/* A file:// URI of 'filename', made absolute */
+static char *file_uri(const char *filename) {
+    char *path = realpath(filename, NULL);
+    if (path == NULL) {
+        char cwd[PATH_MAX];
+        if (filename[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+        while (filename[0] == '.' && filename[1] == '/') filename += 2;
+        size_t n = strlen(cwd) + strlen(filename) + 2;
+        path = xcalloc(1, n);
+        snprintf(path, n, "%s%s%s", cwd, cwd[0] ? "/" : "", filename);
+    }
+    /* Escaped but for the unreserved characters and the slashes */
+    char *uri = xcalloc(1, 7 + strlen(path) * 3 + 1), *p = uri;
+    p += sprintf(p, "file://");
+    for (const unsigned char *s = (const unsigned char *)path; *s; s++) {
+        if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+            (*s >= '0' && *s <= '9') || strchr("-._~/", *s))
+            *p++ = (char)*s;
+        else
+            p += sprintf(p, "%%%02X", *s);
+    }
+    *p = '\0';
+    free(path);
+    return uri;
+}
+
+/* The languageId of a file, by its extension */
+static const char *language_id(const char *filename) {
+    static const char *const ids[][2] = {
+        {"c", "c"}, {"h", "c"}, {"cc", "cpp"}, {"cpp", "cpp"}, {"cxx", "cpp"},
+        {"hpp", "cpp"}, {"hh", "cpp"}, {"py", "python"}, {"lua", "lua"},
+        {"js", "javascript"}, {"ts", "typescript"}, {"rs", "rust"},
+        {"go", "go"}, {"java", "java"}, {"rb", "ruby"}, {"sh", "shellscript"},
+        {"md", "markdown"}, {"json", "json"}, {"zig", "zig"},
+    };
+    const char *dot = strrchr(filename, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+            if (strcmp(dot + 1, ids[i][0]) == 0) return ids[i][1];
+    }
+    return "plaintext";
+}
+
+/* ============================= Writing ================================== */
+
+typedef struct LspWrite {
+    uv_write_t req;         /* Its data is the LspWrite */
+    char head[48];
+    char *body;
+} LspWrite;
+
+static void on_write(uv_write_t *req, int status) {
+    (void)status;           /* A server that is gone is seen to exit */
+    LspWrite *w = req->data;
+    free(w->body);
+    free(w);
+}
+
+/* Start a message without params: a request if id > 0, else a
+ * notification */
+static void message_begin(JsonBuilder *jb, int id, const char *method) {
+    json_builder_init(jb);
+    json_object_start(jb);
+    json_kv_string(jb, "jsonrpc", "2.0");
+    if (id > 0) json_kv_int(jb, "id", id);
+    json_kv_string(jb, "method", method);
+}
+
+/* The same with params, written next */
+static void message_start(JsonBuilder *jb, int id, const char *method) {
+    message_begin(jb, id, method);
+    json_key(jb, "params");
+}
+
+/* Finish the message and send it, framed, freeing the builder */
+static void message_send(LspClient *c, JsonBuilder *jb) {
+    json_object_end(jb);
+    size_t len = json_builder_size(jb);
+    char *body = json_builder_take(jb);
+    json_builder_free(jb);
+    if (body == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    if (c->exited || uv_is_closing((uv_handle_t *)&c->in)) {
+        free(body);
+        return;
+    }
+    LspWrite *w = xcalloc(1, sizeof(LspWrite));
+    int head = snprintf(w->head, sizeof(w->head), "Content-Length: %zu\r\n\r\n", len);
+    w->body = body;
+    w->req.data = w;
+    uv_buf_t bufs[2] = { uv_buf_init(w->head, (unsigned int)head),
+                         uv_buf_init(body, (unsigned int)len) };
+    if (uv_write(&w->req, (uv_stream_t *)&c->in, bufs, 2, on_write) != 0) {
+        free(body);
+        free(w);
+    }
+}
+
+/* Send a request, to be answered to 'doc' (NULL for the client's own) */
+static LspRequest *request_send(LspClient *c, JsonBuilder *jb, int id, int kind,
+                                LspDoc *doc) {
+    message_send(c, jb);
+    LspRequest *r = xcalloc(1, sizeof(LspRequest));
+    r->id = id;
+    r->kind = kind;
+    r->doc = doc;
+    r->next = c->requests;
+    c->requests = r;
+    return r;
+}
+
+static void text_document(JsonBuilder *jb, const LspDoc *doc) {
+    json_key(jb, "textDocument");
+    json_object_start(jb);
+    json_kv_string(jb, "uri", doc->uri);
+    json_object_end(jb);
+}
+
+static void position(JsonBuilder *jb, const char *key, int line, int character) {
+    json_key(jb, key);
+    json_object_start(jb);
+    json_kv_int(jb, "line", line);
+    json_kv_int(jb, "character", character);
+    json_object_end(jb);
+}
+
+/* Rows first..last, each followed by a newline */
+static void rows_text(JsonBuilder *jb, const EditorModel *model, int first, int last) {
+    size_t len = 0;
+    for (int r = first; r <= last; r++) len += (size_t)model->row[r].size + 1;
+    char *text = xcalloc(1, len + 1), *p = text;
+    for (int r = first; r <= last; r++) {
+        memcpy(p, model->row[r].chars, (size_t)model->row[r].size);
+        p += model->row[r].size;
+        *p++ = '\n';
+    }
+    json_string_len(jb, text, len);
+    free(text);
+}
+
+/* ========================= Document sync ================================ */
+
+static void diagnostics_clear(LspDoc *doc) {
+    for (int i = 0; i < doc->ndiags; i++) free(doc->diags[i].message);
+    free(doc->diags);
+    doc->diags = NULL;
+    doc->ndiags = 0;
+    editor_undecorate(&doc->ctx->model, DECOR_GROUP_LSP);
+}
+
+static void did_close(LspDoc *doc) {
+    JsonBuilder jb;
+    message_start(&jb, 0, "textDocument/didClose");
+    json_object_start(&jb);
+    text_document(&jb, doc);
+    json_object_end(&jb);
+    message_send(doc->client, &jb);
+}
+
+/* Open the document in the server, or give it the whole text again:
+ * under another name, it is closed and opened as that */
+static void sync_full(LspDoc *doc) {
+    LspClient *c = doc->client;
+    EditorModel *model = &doc->ctx->model;
+    char *uri = file_uri(model->filename);
+    if (doc->uri && strcmp(doc->uri, uri) != 0) {
+        did_close(doc);
+        free(doc->uri);
+        doc->uri = NULL;
+        diagnostics_clear(doc);
+    }
+
+    JsonBuilder jb;
+    if (doc->uri == NULL) {
+        doc->uri = uri;
+        doc->version = 1;
+        message_start(&jb, 0, "textDocument/didOpen");
+        json_object_start(&jb);
+        json_key(&jb, "textDocument");
+        json_object_start(&jb);
+        json_kv_string(&jb, "uri", doc->uri);
+        json_kv_string(&jb, "languageId", language_id(model->filename));
+        json_kv_int(&jb, "version", doc->version);
+        json_key(&jb, "text");
+        rows_text(&jb, model, 0, model->numrows - 1);
+        json_object_end(&jb);
+        json_object_end(&jb);
+        message_send(c, &jb);
+    } else {
+        free(uri);
+        if (c->sync == 0) return;
+        message_start(&jb, 0, "textDocument/didChange");
+        json_object_start(&jb);
+        json_key(&jb, "textDocument");
+        json_object_start(&jb);
+        json_kv_string(&jb, "uri", doc->uri);
+        json_kv_int(&jb, "version", ++doc->version);
+        json_object_end(&jb);
+        json_key(&jb, "contentChanges");
+        json_array_start(&jb);
+        json_object_start(&jb);
+        json_key(&jb, "text");
+        rows_text(&jb, model, 0, model->numrows - 1);
+        json_object_end(&jb);
+        json_array_end(&jb);
+        json_object_end(&jb);
+        message_send(c, &jb);
+    }
+}
+
+/* Tell the server of the edits made since it was last told */
+static void sync_doc(LspDoc *doc) {
+    LspClient *c = doc->client;
+    EditorModel *model = &doc->ctx->model;
+    doc->sync_due = 0;
+    if (!c->ready || (!doc->full && doc->nspans == 0)) return;
+    if (doc->full || c->sync == 1) {
+        sync_full(doc);
+        doc->full = 0;
+        doc->nspans = 0;
+        doc->rows = model->numrows;
+        return;
+    }
+    if (c->sync == 0) {
+        doc->nspans = 0;
+        doc->rows = model->numrows;
+        return;
+    }
+
+    JsonBuilder jb;
+    message_start(&jb, 0, "textDocument/didChange");
+    json_object_start(&jb);
+    json_key(&jb, "textDocument");
+    json_object_start(&jb);
+    json_kv_string(&jb, "uri", doc->uri);
+    json_kv_int(&jb, "version", ++doc->version);
+    json_object_end(&jb);
+    json_key(&jb, "contentChanges");
+    json_array_start(&jb);
+    int rows = doc->rows;       /* The server's, as the changes apply */
+    for (int i = 0; i < doc->nspans; i++) {
+        const LspSpan *s = &doc->spans[i];
+        int start = s->first < rows ? s->first : rows;
+        int old_end = s->first + s->old_count < rows ? s->first + s->old_count : rows;
+        int last = s->last < model->numrows ? s->last : model->numrows - 1;
+        json_object_start(&jb);
+        json_key(&jb, "range");
+        json_object_start(&jb);
+        position(&jb, "start", start, 0);
+        position(&jb, "end", old_end, 0);
+        json_object_end(&jb);
+        json_key(&jb, "text");
+        if (last >= start) rows_text(&jb, model, start, last);
+        else json_string(&jb, "");
+        json_object_end(&jb);
+        rows += (last >= start ? last - start + 1 : 0) - (old_end - start);
+    }
+    json_array_end(&jb);
+    json_object_end(&jb);
+    message_send(c, &jb);
+    doc->nspans = 0;
+    doc->rows = rows;
+    /* Should the count not come out right, the next sync is whole */
+    if (rows != model->numrows) doc->full = 1;
+}
+
+void lsp_note_edit(EditorModel *model, int row, int old_end, int new_end) {
+    LspDoc *doc = model->lsp;
+    if (doc == NULL || doc->full) return;
+
+    /* The spans touching rows row..old_end are merged with them into one,
+     * in rows as they were before the edit: it replaced as many rows of
+     * the server's text as it covers, less what the spans in it added */
+    LspSpan out[LSP_MAX_SPANS + 1];
+    const LspSpan *s = doc->spans;
+    int n = doc->nspans, i = 0, count = 0;
+    int delta = new_end - old_end;
+    while (i < n && s[i].last < row - 1) out[count++] = s[i++];
+    int first = row, last = old_end, added = 0;
+    while (i < n && s[i].first <= old_end + 1) {
+        if (s[i].first < first) first = s[i].first;
+        if (s[i].last > last) last = s[i].last;
+        added += s[i].last - s[i].first + 1 - s[i].old_count;
+        i++;
+    }
+    out[count].first = first;
+    out[count].last = last + delta;
+    out[count].old_count = last - first + 1 - added;
+    count++;
+    for (; i < n; i++, count++) {
+        out[count] = s[i];
+        out[count].first += delta;
+        out[count].last += delta;
+    }
+
+    /* Too many: the two closest become one, with the rows between */
+    if (count > LSP_MAX_SPANS) {
+        int best = 0;
+        for (int j = 1; j + 1 < count; j++)
+            if (out[j + 1].first - out[j].last < out[best + 1].first - out[best].last)
+                best = j;
+        int gap = out[best + 1].first - out[best].last - 1;
+        out[best].old_count += gap + out[best + 1].old_count;
+        out[best].last = out[best + 1].last;
+        memmove(&out[best + 1], &out[best + 2],
+                (size_t)(count - best - 2) * sizeof(LspSpan));
+        count--;
+    }
+    memcpy(doc->spans, out, (size_t)count * sizeof(LspSpan));
+    doc->nspans = count;
+}
+
+void lsp_note_reset(EditorModel *model) {
+    LspDoc *doc = model->lsp;
+    if (doc == NULL) return;
+    doc->full = 1;
+    doc->nspans = 0;
+}
+
+/* ============================= Requests ================================= */
+
+static void call_cancelled(editor_ctx_t *ctx, int kind, LspResultFn fn, void *opaque) {
+    LspResult result;
+    memset(&result, 0, sizeof(result));
+    result.kind = kind;
+    result.cancelled = 1;
+    fn(ctx, &result, opaque);
+}
+
+/* Drop the document's request of 'kind' waiting, and cancel the one sent */
+static void cancel(LspDoc *doc, int kind) {
+    LspPending *p = &doc->pending[kind];
+    if (p->fn) {
+        LspResultFn fn = p->fn;
+        p->fn = NULL;
+        call_cancelled(doc->ctx, kind, fn, p->opaque);
+    }
+    LspRequest *r = doc->sent[kind];
+    if (r) {
+        doc->sent[kind] = NULL;
+        r->doc = NULL;
+        JsonBuilder jb;
+        message_start(&jb, 0, "$/cancelRequest");
+        json_object_start(&jb);
+        json_kv_int(&jb, "id", r->id);
+        json_object_end(&jb);
+        message_send(doc->client, &jb);
+        LspResultFn fn = r->fn;
+        r->fn = NULL;
+        call_cancelled(doc->ctx, kind, fn, r->opaque);
+    }
+}
+
+int lsp_request(editor_ctx_t *ctx, int kind, LspResultFn fn, void *opaque) {
+    LspDoc *doc = ctx->model.lsp;
+    if (doc == NULL || kind < 0 || kind >= LSP_REQ_KINDS || fn == NULL) return -1;
+    cancel(doc, kind);
+    LspPending *p = &doc->pending[kind];
+    p->fn = fn;
+    p->opaque = opaque;
+    p->row = ctx->view.rowoff + ctx->view.cy;
+    p->col = ctx->view.coloff + ctx->view.cx;
+    p->due = uv_hrtime() + (uint64_t)LSP_DEBOUNCE_MS * 1000000;
+    return 0;
+}
+
+/* Send the request of 'kind' that waited long enough, the edits first */
+static void send_pending(LspDoc *doc, int kind) {
+    LspClient *c = doc->client;
+    EditorModel *model = &doc->ctx->model;
+    LspPending p = doc->pending[kind];
+    doc->pending[kind].fn = NULL;
+    sync_doc(doc);
+
+    int row = p.row, col = p.col;
+    if (row >= model->numrows) row = model->numrows - 1;
+    if (row < 0) row = 0;
+    int character = 0;
+    if (row < model->numrows) {
+        const t_erow *r = &model->row[row];
+        if (col > r->size) col = r->size;
+        character = c->utf8 ? col : utf16_col(r, col);
+    }
+
+    int id = c->next_id++;
+    JsonBuilder jb;
+    message_start(&jb, id, kind == LSP_REQ_COMPLETION ? "textDocument/completion"
+                                                      : "textDocument/hover");
+    json_object_start(&jb);
+    text_document(&jb, doc);
+    position(&jb, "position", row, character);
+    json_object_end(&jb);
+    LspRequest *r = request_send(c, &jb, id, kind, doc);
+    r->fn = p.fn;
+    r->opaque = p.opaque;
+    doc->sent[kind] = r;
+}
+
+/* ============================== Answers ================================= */
+
+/* Completions of a CompletionItem[] or CompletionList */
+static void completion_result(LspDoc *doc, LspRequest *r, const JsonValue *v) {
+    if (v && v->type == JSON_OBJECT) v = json_object_get(v, "items");
+    LspItem *items = NULL;
+    int count = 0;
+    if (v && v->type == JSON_ARRAY && v->data.array_val.count > 0) {
+        items = xcalloc(v->data.array_val.count, sizeof(LspItem));
+        for (size_t i = 0; i < v->data.array_val.count; i++) {
+            const JsonValue *item = &v->data.array_val.items[i];
+            const char *label = json_object_get_string(item, "label");
+            if (label == NULL) continue;
+            const char *insert = NULL;
+            const JsonValue *edit = json_object_get(item, "textEdit");
+            if (edit) insert = json_object_get_string(edit, "newText");
+            if (insert == NULL) insert = json_object_get_string(item, "insertText");
+            items[count].label = label;
+            items[count].detail = json_object_get_string(item, "detail");
+            items[count].insert = insert ? insert : label;
+            count++;
+        }
+    }
+    LspResult result;
+    memset(&result, 0, sizeof(result));
+    result.kind = LSP_REQ_COMPLETION;
+    result.items = items;
+    result.count = count;
+    r->fn(doc->ctx, &result, r->opaque);
+    free(items);
+}
+
+/* Append the text of a MarkedString or MarkupContent */
+static void hover_append(char **text, size_t *len, const JsonValue *v) {
+    const char *s = NULL;
+    if (v->type == JSON_STRING) s = v->data.string_val.str;
+    else if (v->type == JSON_OBJECT) s = json_object_get_string(v, "value");
+    if (s == NULL || *s == '\0') return;
+    size_t n = strlen(s);
+    char *grown = realloc(*text, *len + n + 2);
+    if (grown == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *text = grown;
+    if (*len) grown[(*len)++] = '\n';
+    memcpy(grown + *len, s, n + 1);
+    *len += n;
+}
+
+static void hover_result(LspDoc *doc, LspRequest *r, const JsonValue *v) {
+    char *text = NULL;
+    size_t len = 0;
+    const JsonValue *contents = v ? json_object_get(v, "contents") : NULL;
+    if (contents && contents->type == JSON_ARRAY) {
+        for (size_t i = 0; i < contents->data.array_val.count; i++)
+            hover_append(&text, &len, &contents->data.array_val.items[i]);
+    } else if (contents) {
+        hover_append(&text, &len, contents);
+    }
+    LspResult result;
+    memset(&result, 0, sizeof(result));
+    result.kind = LSP_REQ_HOVER;
+    result.text = text;
+    r->fn(doc->ctx, &result, r->opaque);
+    free(text);
+}
+
+static void initialized(LspClient *c, const JsonValue *v) {
+    const JsonValue *caps = v ? json_object_get(v, "capabilities") : NULL;
+    const char *encoding = json_object_get_string(caps, "positionEncoding");
+    c->utf8 = encoding && strcmp(encoding, "utf-8") == 0;
+    const JsonValue *sync = json_object_get(caps, "textDocumentSync");
+    if (sync && sync->type == JSON_INT) c->sync = sync->data.int_val;
+    else if (sync && sync->type == JSON_OBJECT) c->sync = json_object_get_int(sync, "change", 0);
+    c->ready = 1;
+
+    JsonBuilder jb;
+    message_start(&jb, 0, "initialized");
+    json_object_start(&jb);
+    json_object_end(&jb);
+    message_send(c, &jb);
+    for (LspDoc *doc = c->docs; doc; doc = doc->next) sync_doc(doc);
+}
+
+static void diagnostics(LspClient *c, const JsonValue *params) {
+    const char *uri = json_object_get_string(params, "uri");
+    LspDoc *doc = c->docs;
+    while (doc && (uri == NULL || doc->uri == NULL || strcmp(doc->uri, uri) != 0))
+        doc = doc->next;
+    if (doc == NULL) return;
+    diagnostics_clear(doc);
+    const JsonValue *list = json_object_get(params, "diagnostics");
+    if (list == NULL || list->type != JSON_ARRAY || list->data.array_val.count == 0)
+        return;
+
+    EditorModel *model = &doc->ctx->model;
+    doc->diags = xcalloc(list->data.array_val.count, sizeof(LspDiagnostic));
+    for (size_t i = 0; i < list->data.array_val.count; i++) {
+        const JsonValue *d = &list->data.array_val.items[i];
+        const JsonValue *range = json_object_get(d, "range");
+        const JsonValue *start = json_object_get(range, "start");
+        const JsonValue *end = json_object_get(range, "end");
+        const char *message = json_object_get_string(d, "message");
+        if (start == NULL || end == NULL) continue;
+        LspDiagnostic *out = &doc->diags[doc->ndiags++];
+        out->row = json_object_get_int(start, "line", 0);
+        out->col = from_character(c, model, out->row,
+                                  json_object_get_int(start, "character", 0));
+        out->end_row = json_object_get_int(end, "line", out->row);
+        out->end_col = from_character(c, model, out->end_row,
+                                      json_object_get_int(end, "character", 0));
+        if (out->end_row < out->row) out->end_row = out->row;
+        out->severity = json_object_get_int(d, "severity", 1);
+        out->message = xstrdup(message ? message : "");
+
+        unsigned char hl = out->severity <= 1 ? LSP_HL_ERROR
+                         : out->severity == 2 ? LSP_HL_WARNING : LSP_HL_INFO;
+        for (int row = out->row; row <= out->end_row && row < model->numrows; row++) {
+            int size = model->row[row].size;
+            int from = row == out->row ? out->col : 0;
+            int to = row == out->end_row ? out->end_col : size;
+            /* An empty range marks the character it is at, or the last */
+            if (to <= from) {
+                if (from >= size) from = size - 1;
+                to = from + 1;
+            }
+            if (from >= 0) editor_decorate(model, DECOR_GROUP_LSP, row, from, to - from, hl);
+        }
+    }
+}
+
+/* Answer a request of the server's: with nothing, but for the settings
+ * asked for by workspace/configuration, none of which are known */
+static void answer(LspClient *c, const LspMessage *m, const JsonValue *params) {
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_string(&jb, "jsonrpc", "2.0");
+    json_key(&jb, "id");
+    if (m->id_string) json_string(&jb, m->id_string);
+    else json_int(&jb, m->id);
+    json_key(&jb, "result");
+    const JsonValue *items = json_object_get(params, "items");
+    if (strcmp(m->method, "workspace/configuration") == 0 && items &&
+        items->type == JSON_ARRAY) {
+        json_array_start(&jb);
+        for (size_t i = 0; i < items->data.array_val.count; i++) json_null(&jb);
+        json_array_end(&jb);
+    } else {
+        json_null(&jb);
+    }
+    message_send(c, &jb);
+}
+
+static LspRequest *take_request(LspClient *c, int id) {
+    for (LspRequest **p = &c->requests; *p; p = &(*p)->next) {
+        if ((*p)->id == id) {
+            LspRequest *r = *p;
+            *p = r->next;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void close_handle(uv_handle_t *handle);
+static void teardown(LspClient *c, const char *why);
+
+static void handle(LspClient *c, LspMessage *m) {
+    JsonDoc jd;
+    memset(&jd, 0, sizeof(jd));
+    const JsonValue *v = NULL;
+    if (m->body && json_doc_parse_insitu(&jd, m->body, m->body_len) == 0)
+        v = &jd.root;
+
+    if (m->method && m->has_id) {
+        answer(c, m, v);
+    } else if (m->method) {
+        if (strcmp(m->method, "textDocument/publishDiagnostics") == 0 && v)
+            diagnostics(c, v);
+    } else {
+        LspRequest *r = take_request(c, m->id);
+        if (r && r->kind == REQ_INITIALIZE) {
+            if (m->error) teardown(c, "failed to start");
+            else initialized(c, v);
+        } else if (r && r->kind == REQ_SHUTDOWN) {
+            JsonBuilder jb;
+            message_begin(&jb, 0, "exit");
+            message_send(c, &jb);
+            close_handle((uv_handle_t *)&c->in);
+        } else if (r && r->doc) {
+            LspDoc *doc = r->doc;
+            doc->sent[r->kind] = NULL;
+            if (m->error) call_cancelled(doc->ctx, r->kind, r->fn, r->opaque);
+            else if (r->kind == LSP_REQ_COMPLETION) completion_result(doc, r, v);
+            else hover_result(doc, r, v);
+        }
+        free(r);
+    }
+    if (m->body) json_doc_free(&jd);
+}
+
+/* ============================== Reading ================================= */
+
+static void message_free(LspMessage *m) {
+    if (m == NULL) return;
+    free(m->id_string);
+    free(m->method);
+    free(m->body);
+    free(m);
+}
+
+/* Whether the result or params of the message being read are of use:
+ * a notification or request handled, or the answer to a live request.
+ * Kept when the id and method are not known yet. */
+static int wanted(const LspClient *c, const LspMessage *m) {
+    if (m->method)
+        return strcmp(m->method, "textDocument/publishDiagnostics") == 0 ||
+               (m->has_id && strcmp(m->method, "workspace/configuration") == 0);
+    if (!m->has_id) return 1;
+    for (const LspRequest *r = c->requests; r; r = r->next)
+        if (r->id == m->id) return r->kind >= LSP_REQ_KINDS || r->doc != NULL;
+    return 0;
+}
+
+static int on_json(void *opaque, JsonStream *s, JsonEvent ev, const char *text,
+                   size_t len) {
+    LspClient *c = opaque;
+    LspMessage *m = c->cur;
+    switch (ev) {
+    case JSON_EV_VALUE:
+        free(m->body);
+        m->body = xcalloc(1, len + 1);
+        memcpy(m->body, text, len);
+        m->body_len = len;
+        break;
+    case JSON_EV_OBJECT_START:
+    case JSON_EV_ARRAY_START:
+        if (json_stream_depth(s) == 0) {
+            if (ev == JSON_EV_ARRAY_START) json_stream_skip(s);     /* A batch */
+        } else if ((json_stream_at(s, "result") || json_stream_at(s, "params")) &&
+                   wanted(c, m)) {
+            json_stream_capture(s);
+        } else {
+            if (json_stream_at(s, "error")) m->error = 1;
+            json_stream_skip(s);
+        }
+        break;
+    case JSON_EV_NUMBER:
+    case JSON_EV_STRING:
+        if (json_stream_at(s, "id") && !m->has_id) {
+            m->has_id = 1;
+            if (ev == JSON_EV_NUMBER) m->id = atoi(text);
+            else m->id_string = xstrdup(text);
+        } else if (ev == JSON_EV_STRING && json_stream_at(s, "method") && !m->method) {
+            m->method = xstrdup(text);
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* The body of the message being read is all in */
+static void body_end(LspClient *c) {
+    LspMessage *m = c->cur;
+    c->cur = NULL;
+    c->in_body = 0;
+    if (m && json_stream_finish(c->js) == 0 && (m->has_id || m->method)) {
+        *c->inbox_tail = m;
+        c->inbox_tail = &m->next;
+    } else {
+        message_free(m);
+    }
+}
+
+/* The header is all in: start on the body */
+static void body_start(LspClient *c) {
+    c->header[c->header_len] = '\0';
+    c->header_len = 0;
+    long long len = -1;
+    for (char *line = c->header; line; ) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) len = atoll(line + 15);
+        line = strstr(line, "\r\n");
+        if (line) line += 2;
+    }
+    if (len < 0 || (size_t)len > LSP_MESSAGE_MAX) {
+        c->bad = 1;
+        return;
+    }
+    c->in_body = 1;
+    c->body_left = (size_t)len;
+    json_stream_reset(c->js);
+    c->cur = xcalloc(1, sizeof(LspMessage));
+    if (len == 0) body_end(c);
+}
+
+static void take(LspClient *c, const char *data, size_t n) {
+    while (n > 0 && !c->bad) {
+        if (!c->in_body) {
+            if (c->header_len == sizeof(c->header) - 1) {
+                c->bad = 1;
+                break;
+            }
+            c->header[c->header_len++] = *data++;
+            n--;
+            if (c->header_len >= 4 &&
+                memcmp(c->header + c->header_len - 4, "\r\n\r\n", 4) == 0)
+                body_start(c);
+            continue;
+        }
+        size_t k = n < c->body_left ? n : c->body_left;
+        if (c->cur && json_stream_feed(c->js, data, k) != 0) {
+            message_free(c->cur);
+            c->cur = NULL;
+        }
+        data += k;
+        n -= k;
+        c->body_left -= k;
+        if (c->body_left == 0) body_end(c);
+    }
+}
+
+/* ============================== Process ================================= */
+
+static void client_free(LspClient *c) {
+    while (c->requests) {
+        LspRequest *r = c->requests;
+        c->requests = r->next;
+        free(r);
+    }
+    while (c->inbox) {
+        LspMessage *m = c->inbox;
+        c->inbox = m->next;
+        message_free(m);
+    }
+    message_free(c->cur);
+    json_stream_free(c->js);
+    free(c->rbuf);
+    free(c->cmd);
+    free(c);
+}
+
+static void on_close(uv_handle_t *handle) {
+    LspClient *c = handle->data;
+    if (--c->open == 0 && c->closing) client_free(c);
+}
+
+static void close_handle(uv_handle_t *handle) {
+    if (!uv_is_closing(handle)) uv_close(handle, on_close);
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    (void)suggested;
+    LspClient *c = handle->data;
+    if (c->rbuf == NULL) c->rbuf = xcalloc(1, LSP_READ_CHUNK);
+    *buf = uv_buf_init(c->rbuf, (unsigned int)LSP_READ_CHUNK);
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    LspClient *c = stream->data;
+    if (nread > 0) take(c, buf->base, (size_t)nread);
+    else if (nread < 0) uv_read_stop(stream);
+}
+
+static void on_proc_exit(uv_process_t *proc, int64_t status, int term_signal) {
+    (void)status;
+    (void)term_signal;
+    LspClient *c = proc->data;
+    c->exited = 1;
+    close_handle((uv_handle_t *)proc);
+}
+
+static LspClient *client_start(editor_ctx_t *ctx, const char *cmd) {
+    static int sigpipe_ignored;
+    /* A server that quits is an EPIPE from the write, not the end of the
+     * editor */
+    if (!sigpipe_ignored) {
+        signal(SIGPIPE, SIG_IGN);
+        sigpipe_ignored = 1;
+    }
+
+    LspClient *c = xcalloc(1, sizeof(LspClient));
+    c->cmd = xstrdup(cmd);
+    c->next_id = 1;
+    c->inbox_tail = &c->inbox;
+    c->js = json_stream_new(on_json, c);
+    if (c->js == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    uv_loop_t *loop = uv_default_loop();
+    uv_pipe_init(loop, &c->in, 0);
+    uv_pipe_init(loop, &c->out, 0);
+    c->in.data = c->out.data = c->proc.data = c;
+    c->open = 3;
+
+    char *args[] = { "sh", "-c", c->cmd, NULL };
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+    stdio[0].data.stream = (uv_stream_t *)&c->in;
+    stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[1].data.stream = (uv_stream_t *)&c->out;
+    stdio[2].flags = UV_IGNORE;
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.file = "/bin/sh";
+    options.args = args;
+    options.exit_cb = on_proc_exit;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+    int rc = uv_spawn(loop, &c->proc, &options);
+    if (rc != 0) {
+        editor_set_status_msg(ctx, "Cannot run %.40s: %s", cmd, uv_strerror(rc));
+        c->closing = 1;
+        close_handle((uv_handle_t *)&c->in);
+        close_handle((uv_handle_t *)&c->out);
+        close_handle((uv_handle_t *)&c->proc);
+        return NULL;
+    }
+    uv_read_start((uv_stream_t *)&c->out, on_alloc, on_read);
+    c->next = clients;
+    clients = c;
+
+    int id = c->next_id++;
+    char *root = file_uri(".");
+    JsonBuilder jb;
+    message_start(&jb, id, "initialize");
+    json_object_start(&jb);
+    json_kv_int(&jb, "processId", (int)getpid());
+    json_key(&jb, "clientInfo");
+    json_object_start(&jb);
+    json_kv_string(&jb, "name", "loki");
+    json_object_end(&jb);
+    json_kv_string(&jb, "rootUri", root);
+    json_key(&jb, "capabilities");
+    json_object_start(&jb);
+    json_key(&jb, "general");
+    json_object_start(&jb);
+    json_key(&jb, "positionEncodings");
+    json_array_start(&jb);
+    json_string(&jb, "utf-8");
+    json_string(&jb, "utf-16");
+    json_array_end(&jb);
+    json_object_end(&jb);
+    json_key(&jb, "textDocument");
+    json_object_start(&jb);
+    json_key(&jb, "synchronization");
+    json_object_start(&jb);
+    json_object_end(&jb);
+    json_key(&jb, "completion");
+    json_object_start(&jb);
+    json_object_end(&jb);
+    json_key(&jb, "hover");
+    json_object_start(&jb);
+    json_key(&jb, "contentFormat");
+    json_array_start(&jb);
+    json_string(&jb, "plaintext");
+    json_string(&jb, "markdown");
+    json_array_end(&jb);
+    json_object_end(&jb);
+    json_key(&jb, "publishDiagnostics");
+    json_object_start(&jb);
+    json_object_end(&jb);
+    json_object_end(&jb);
+    json_object_end(&jb);
+    json_object_end(&jb);
+    request_send(c, &jb, id, REQ_INITIALIZE, NULL);
+    free(root);
+    return c;
+}
+
+/* Take the document off its server: its requests cancelled, its file
+ * closed there and its diagnostics removed */
+static void detach(LspDoc *doc) {
+    LspClient *c = doc->client;
+    doc->ctx->model.lsp = NULL;
+    for (LspDoc **p = &c->docs; *p; p = &(*p)->next) {
+        if (*p == doc) {
+            *p = doc->next;
+            break;
+        }
+    }
+    for (int kind = 0; kind < LSP_REQ_KINDS; kind++) cancel(doc, kind);
+    if (doc->uri) did_close(doc);
+    diagnostics_clear(doc);
+    free(doc->uri);
+    free(doc);
+}
+
+/* Take the client off the list, its documents off it, and close it */
+static void teardown(LspClient *c, const char *why) {
+    while (c->docs) {
+        editor_ctx_t *ctx = c->docs->ctx;
+        detach(c->docs);
+        if (why) editor_set_status_msg(ctx, "Language server %.40s %s", c->cmd, why);
+    }
+    for (LspClient **p = &clients; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    c->closing = 1;
+    close_handle((uv_handle_t *)&c->in);
+    close_handle((uv_handle_t *)&c->out);
+    if (!c->exited) uv_process_kill(&c->proc, SIGTERM);
+}
+
+/* No document uses the server: ask it to shut down, kill it if it does
+ * not in time */
+static void client_stop(LspClient *c) {
+    if (!c->ready || c->exited) {
+        teardown(c, NULL);
+        return;
+    }
+    int id = c->next_id++;
+    JsonBuilder jb;
+    message_begin(&jb, id, "shutdown");
+    request_send(c, &jb, id, REQ_SHUTDOWN, NULL);
+    c->stop_at = uv_hrtime() + (uint64_t)LSP_STOP_MS * 1000000;
+}
+
+/* ================================ API =================================== */
+
+int lsp_start(editor_ctx_t *ctx, const char *cmd) {
+    EditorModel *model = &ctx->model;
+    if (model->filename == NULL) {
+        editor_set_status_msg(ctx, "No file name to give the language server");
+        return -1;
+    }
+    if (model->lazy) {
+        editor_set_status_msg(ctx, "Not for a file read in part");
+        return -1;
+    }
+    lsp_stop(model);
+
+    LspClient *c = clients;
+    while (c && (c->stop_at || c->exited || strcmp(c->cmd, cmd) != 0)) c = c->next;
+    int shared = c != NULL;
+    if (c == NULL && (c = client_start(ctx, cmd)) == NULL) return -1;
+
+    LspDoc *doc = xcalloc(1, sizeof(LspDoc));
+    doc->ctx = ctx;
+    doc->client = c;
+    doc->full = 1;
+    doc->next = c->docs;
+    c->docs = doc;
+    model->lsp = doc;
+    if (c->ready) sync_doc(doc);
+    editor_set_status_msg(ctx, "Language server %.40s %s", cmd,
+                          shared ? "attached" : "starting");
+    return 0;
+}
+
+void lsp_stop(EditorModel *model) {
+    LspDoc *doc = model->lsp;
+    if (doc == NULL) return;
+    LspClient *c = doc->client;
+    detach(doc);
+    if (c->docs == NULL && !c->stop_at) client_stop(c);
+}
+
+int lsp_diagnostics(const EditorModel *model, const LspDiagnostic **diags) {
+    const LspDoc *doc = model->lsp;
+    *diags = doc ? doc->diags : NULL;
+    return doc ? doc->ndiags : 0;
+}
+
+const char *lsp_server(const EditorModel *model) {
+    return model->lsp ? model->lsp->client->cmd : NULL;
+}
+
+/* Sooner of 'due' and *next (0: none yet) */
+static void sooner(uint64_t *next, uint64_t due) {
+    if (*next == 0 || due < *next) *next = due;
+}
+
+int lsp_tick(uint64_t now) {
+    uint64_t next = 0;
+    for (LspClient *c = clients, *nc; c; c = nc) {
+        nc = c->next;
+        while (c->inbox && !c->closing) {
+            LspMessage *m = c->inbox;
+            c->inbox = m->next;
+            if (c->inbox == NULL) c->inbox_tail = &c->inbox;
+            handle(c, m);
+            message_free(m);
+        }
+        if (c->closing) continue;
+        if (c->exited) {
+            teardown(c, c->stop_at ? NULL : "exited");
+            continue;
+        }
+        if (c->stop_at) {
+            if (now >= c->stop_at) {
+                uv_process_kill(&c->proc, SIGTERM);
+                c->stop_at = UINT64_MAX;
+            } else {
+                sooner(&next, c->stop_at);
+            }
+            continue;
+        }
+        if (!c->ready) continue;
+
+        for (LspDoc *doc = c->docs; doc; doc = doc->next) {
+            if (doc->full || doc->nspans > 0) {
+                if (doc->sync_due == 0)
+                    doc->sync_due = now + (uint64_t)LSP_SYNC_MS * 1000000;
+                if (now >= doc->sync_due) sync_doc(doc);
+                else sooner(&next, doc->sync_due);
+            }
+            for (int kind = 0; kind < LSP_REQ_KINDS; kind++) {
+                if (doc->pending[kind].fn == NULL) continue;
+                if (now >= doc->pending[kind].due) send_pending(doc, kind);
+                else sooner(&next, doc->pending[kind].due);
+            }
+        }
+    }
+    if (next == 0) return -1;
+    return (int)((next - now + 999999) / 1000000);
+}
+
+void lsp_stop_all(void) {
+    while (clients) {
+        LspClient *c = clients;
+        teardown(c, NULL);
+        if (!c->exited) close_handle((uv_handle_t *)&c->proc);
+    }
+}
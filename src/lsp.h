@@ -0,0 +1,125 @@
+/* lsp.h - Language Server Protocol client
+ *
+ * lsp_start() runs a language server with `sh -c` (uv_spawn()) on the
+ * loop event_loop_wait() sleeps in, and opens the buffer's file in it.
+ * Buffers started with the same command share one server. Messages are
+ * JSON-RPC framed by a Content-Length header; what the server writes is
+ * fed to a json_stream as it is read, which picks out the id and method
+ * of each message and keeps the text of its result or params only if
+ * they are wanted: the answer to a request that was cancelled, or a
+ * notification that is not handled, is skipped over without being
+ * parsed. Messages kept wait for lsp_tick(), run by the main loop.
+ *
+ * Edits go to the server as textDocument/didChange changes of whole
+ * lines, never the whole document (unless the server only takes that).
+ * They are noted as they are made (lsp_note_edit(), from the edit paths
+ * of core.c that also feed the syntax tree) as spans of rows changed
+ * since the server was last told: an edit next to or over a span grows
+ * it, and those below it move. A change is sent per span, with the rows
+ * it now holds, LSP_SYNC_MS after the first edit, or at once before a
+ * request: a burst of typing on one line is one change of one line.
+ *
+ * Diagnostics the server publishes are decorated in DECOR_GROUP_LSP,
+ * styled by severity, and kept for lsp_diagnostics(). Completion and
+ * hover requests (lsp_request()) wait LSP_DEBOUNCE_MS for a newer one
+ * before they are sent; a newer one replaces one still waiting, and has
+ * one already sent cancelled ($/cancelRequest). Every request gets its
+ * result function called once: with the answer, or marked cancelled.
+ *
+ * Positions are sent in UTF-8 bytes if the server takes them (LSP 3.17
+ * positionEncoding), in UTF-16 code units otherwise.
+ */
+
+#ifndef LOKI_LSP_H
+#define LOKI_LSP_H
+
+#include <stdint.h>
+#include "internal.h"
+
+/* Edits are sent this long after the first one not yet sent */
+#define LSP_SYNC_MS 50
+
+/* A completion or hover request waits this long for a newer one */
+#define LSP_DEBOUNCE_MS 100
+
+/* Spans of changed rows kept per document before the closest are merged */
+#define LSP_MAX_SPANS 16
+
+/* Decoration styles of diagnostics, by severity */
+#define LSP_HL_ERROR   HL_MATCH
+#define LSP_HL_WARNING HL_KEYWORD1
+#define LSP_HL_INFO    HL_COMMENT
+
+/* Requests, by kind */
+#define LSP_REQ_COMPLETION 0
+#define LSP_REQ_HOVER      1
+#define LSP_REQ_KINDS      2
+
+typedef struct LspDoc LspDoc;
+
+/* A completion offered */
+typedef struct LspItem {
+    const char *label;
+    const char *detail;     /* Or NULL */
+    const char *insert;     /* Text to insert: the label if not given */
+} LspItem;
+
+/* The answer to a request, valid for the call. When 'cancelled' (a newer
+ * request came, the buffer was detached or the server failed) nothing
+ * else is set. */
+typedef struct LspResult {
+    int kind;               /* LSP_REQ_* */
+    int cancelled;
+    const LspItem *items;   /* Completions */
+    int count;
+    const char *text;       /* Hover text, or NULL if none */
+} LspResult;
+
+typedef void (*LspResultFn)(editor_ctx_t *ctx, const LspResult *result,
+                            void *opaque);
+
+/* A diagnostic as published: rows and byte columns, the end exclusive */
+typedef struct LspDiagnostic {
+    int row, col;
+    int end_row, end_col;
+    int severity;           /* 1 error, 2 warning, 3 information, 4 hint */
+    char *message;
+} LspDiagnostic;
+
+/* Open the buffer's file in the server run by 'cmd', starting it unless
+ * a buffer uses it already. Returns 0, or -1 with the reason in the
+ * status. */
+int lsp_start(editor_ctx_t *ctx, const char *cmd);
+
+/* Close the buffer's file in its server, cancelling its requests and
+ * removing its diagnostics; a server no buffer uses is shut down. Safe on
+ * a model not attached. */
+void lsp_stop(EditorModel *model);
+
+/* Rows row..old_end of the buffer became rows row..new_end. */
+void lsp_note_edit(EditorModel *model, int row, int old_end, int new_end);
+
+/* The buffer's rows were all replaced, or its file renamed: the server is
+ * sent the whole text (and the new name) next time. */
+void lsp_note_reset(EditorModel *model);
+
+/* Ask the buffer's server for completions (LSP_REQ_COMPLETION) or hover
+ * text (LSP_REQ_HOVER) at the cursor, once LSP_DEBOUNCE_MS have passed
+ * without a newer request. 'fn' gets the result. Returns 0, or -1 if the
+ * buffer has no server ('fn' is then not called). */
+int lsp_request(editor_ctx_t *ctx, int kind, LspResultFn fn, void *opaque);
+
+/* The diagnostics last published for the buffer. Returns their number. */
+int lsp_diagnostics(const EditorModel *model, const LspDiagnostic **diags);
+
+/* The command of the buffer's server, or NULL if it has none */
+const char *lsp_server(const EditorModel *model);
+
+/* Handle what the servers sent, send edits and requests that are due.
+ * Returns the milliseconds until more are due, or -1 if none wait. */
+int lsp_tick(uint64_t now);
+
+/* Kill all servers and forget them, as the editor exits. */
+void lsp_stop_all(void);
+
+#endif /* LOKI_LSP_H */
@@ -21,6 +21,7 @@
 #include <stdarg.h>
 #include <unistd.h>   /* for access */
 #include <ctype.h>    /* for isspace, isprint, tolower */
+#include <uv.h>       /* uv_hrtime() */
 
 #include "lua.h"
 #include "lualib.h"
@@ -35,6 +36,37 @@
 #include "command.h"  /* Command mode and ex-style commands */
 #include "lang_bridge.h"  /* Language bridge for Lua API registration */
 #include "buffers.h"    /* Buffer management for buffer_get_current() */
+#include "arena.h"      /* Row arena statistics for loki.memstats() */
+#include "memstats.h"   /* Memory by subsystem for loki.memstats() */
+#include "startup.h"    /* Bootstrap phases for --startup-time */
+#include "undo.h"       /* Undo history statistics for loki.undostats() */
+#include "syntax.h"     /* syntax_colors_changed() after theme edits */
+#include "regexp.h"     /* loki.search() */
+#include "grep.h"       /* loki.grep() */
+#include "bsearch.h"    /* loki.search_buffers() */
+#include "search_index.h" /* Rows loki.search() reads */
+#include "search.h"     /* search_ignores_case() */
+#include "async_queue.h" /* Event queue counters for loki.queuestats() */
+#include "timer_wheel.h" /* loki.set_timeout() and loki.set_interval() */
+#include "lua_cache.h"  /* init.lua and modules compiled once */
+#include "lua_worker.h" /* loki.spawn() */
+#include "lua_profile.h" /* Entry point timings, :profile lua */
+#include "lua_gc.h"      /* Collection in idle time */
+#include "completion.h"  /* Console tab completion */
+#include "idle.h"        /* loki.defer() */
+#include "decor.h"       /* loki.decorate() */
+#include "marks.h"       /* loki.mark_set() */
+#include "history.h"     /* Console input history */
+#include "fold.h"        /* loki.fold() */
+#include "filter.h"      /* loki.pipe() */
+#include "job.h"         /* loki.job_start() */
+#include "lsp.h"         /* loki.lsp_start() */
+#include "changes.h"     /* loki.on_change() */
+#include "autocmd.h"     /* loki.autocmd() */
+#include "symbols.h"     /* loki.symbols() */
+#include "finder.h"      /* loki.find_files() */
+#include "ai_context.h"  /* loki.ai_context() */
+#include "ghost.h"       /* loki.ghost_show() */
 #ifdef LOKI_ENABLE_HTTP
 #include "http.h"       /* Async HTTP support */
 #endif
@@ -90,79 +122,1928 @@ static int lua_loki_get_line(lua_State *L) {
     return 1;
 }
 
+/* 'src' compiled, reusing the last one loki.search() compiled */
+static Regexp *lua_search_regexp(LuaHost *host, const char *src, int flags,
+                                 const char **error) {
+    *error = NULL;
+    if (host->search_re && host->search_flags == flags &&
+        strcmp(host->search_src, src) == 0)
+        return host->search_re;
+
+    regexp_free(host->search_re);
+    free(host->search_src);
+    host->search_src = NULL;
+    host->search_re = regexp_compile(src, flags, error);
+    if (host->search_re) {
+        host->search_src = strdup(src);
+        host->search_flags = flags;
+        if (!host->search_src) {
+            regexp_free(host->search_re);
+            host->search_re = NULL;
+            *error = "Out of memory";
+        }
+    }
+    return host->search_re;
+}
+
+static int lua_search_in(lua_State *L, LuaHost *host, editor_ctx_t *ctx,
+                         const char *pattern, int opts);
+
+/* Lua API: loki.search(pattern [, opts]) - Find a regex match (0-indexed)
+ * opts: literal (match the pattern's text itself), icase (default: as
+ * loki.ignorecase() and loki.smartcase() say), and row, col to start at
+ * (default 0, 0). Searches forward without wrapping. Returns
+ * row, col, len in chars, nil when there is no match, or nil and a
+ * message when the pattern is invalid. */
+static int lua_loki_search(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx || !ctx->lua_host) return 0;
+    return lua_search_in(L, ctx->lua_host, ctx, luaL_checkstring(L, 1), 2);
+}
+
+/* loki.search() in 'ctx', with the options table at 'opts' */
+static int lua_search_in(lua_State *L, LuaHost *host, editor_ctx_t *ctx,
+                         const char *pattern, int opts) {
+    int literal = 0, icase = -1, row = 0, col = 0;
+    if (lua_istable(L, opts)) {
+        lua_getfield(L, opts, "literal");
+        literal = lua_toboolean(L, -1);
+        lua_getfield(L, opts, "icase");
+        if (!lua_isnil(L, -1)) icase = lua_toboolean(L, -1);
+        lua_getfield(L, opts, "row");
+        if (lua_isnumber(L, -1)) row = (int)lua_tointeger(L, -1);
+        lua_getfield(L, opts, "col");
+        if (lua_isnumber(L, -1)) col = (int)lua_tointeger(L, -1);
+        lua_pop(L, 4);
+    }
+
+    if (icase < 0)
+        icase = search_ignores_case(ctx, pattern, (int)strlen(pattern), !literal);
+    int flags = icase ? REGEXP_ICASE : 0;
+
+    /* A literal is escaped byte by byte into a regex matching only it */
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (const char *p = pattern; *p; p++) {
+        if (literal && !isalnum((unsigned char)*p)) luaL_addchar(&b, '\\');
+        luaL_addchar(&b, *p);
+    }
+    luaL_pushresult(&b);
+
+    const char *error;
+    Regexp *re = lua_search_regexp(host, lua_tostring(L, -1), flags, &error);
+    lua_pop(L, 1);
+    if (!re) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    /* Only rows the search index lists can match */
+    const char *lit;
+    int litlen = regexp_required(re, &lit);
+    SearchRanges rows = {NULL, 0, 0};
+    search_index_lookup(&ctx->model, lit, litlen, &rows);
+
+    if (row < 0) row = 0;
+    for (int i = search_ranges_find(&rows, row); i < rows.n; i++) {
+        int r = rows.r[i].first > row ? rows.r[i].first : row;
+        for (; r <= rows.r[i].last; r++) {
+            t_erow *er = &ctx->model.row[r];
+            int start, end;
+            if (regexp_search(re, er->chars, er->size, r == row ? col : 0,
+                              &start, &end)) {
+                search_ranges_free(&rows);
+                lua_pushinteger(L, r);
+                lua_pushinteger(L, start);
+                lua_pushinteger(L, end - start);
+                return 3;
+            }
+        }
+    }
+    search_ranges_free(&rows);
+    lua_pushnil(L);
+    return 1;
+}
+
+/* loki.grep() state: the results table is at the top of the stack */
+typedef struct {
+    lua_State *L;
+    int count, max;
+} LuaGrep;
+
+static int lua_grep_match(const GrepMatch *m, void *arg) {
+    LuaGrep *g = arg;
+    lua_State *L = g->L;
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, m->path);
+    lua_setfield(L, -2, "file");
+    lua_pushinteger(L, m->line);
+    lua_setfield(L, -2, "line");
+    lua_pushinteger(L, m->col);
+    lua_setfield(L, -2, "col");
+    lua_pushlstring(L, m->text, (size_t)m->len);
+    lua_setfield(L, -2, "text");
+    lua_rawseti(L, -2, ++g->count);
+    return g->max > 0 && g->count >= g->max;
+}
+
+/* Lua API: loki.grep(pattern [, path [, opts]]) - Search the files under
+ * path (default ".") like :grep, and wait for the result. opts: literal,
+ * icase, and max (stop after this many matches). Returns an array of
+ * {file, line, col, text} with 1-based line and col, one per matching
+ * line, or nil and a message. */
+static int lua_loki_grep(lua_State *L) {
+    const char *pattern = luaL_checkstring(L, 1);
+    const char *path = luaL_optstring(L, 2, ".");
+    int flags = 0;
+    LuaGrep g = {L, 0, 0};
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "literal");
+        if (lua_toboolean(L, -1)) flags |= GREP_LITERAL;
+        lua_getfield(L, 3, "icase");
+        if (lua_toboolean(L, -1)) flags |= GREP_ICASE;
+        lua_getfield(L, 3, "max");
+        if (lua_isnumber(L, -1)) g.max = (int)lua_tointeger(L, -1);
+        lua_pop(L, 3);
+    }
+
+    lua_newtable(L);
+    const char *error;
+    if (grep_run(pattern, path, flags, lua_grep_match, &g, &error) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    return 1;
+}
+
+/* Lua API: loki.search_buffers(pattern [, opts]) - Search every open
+ * buffer like :bsearch, and wait for the result. opts: literal, icase
+ * (default: as :set ignorecase and smartcase say), and max (stop after
+ * this many matches). Returns an array of {buffer, name, line, col, len,
+ * text} with 1-based line and col, one per match, or nil and a message. */
+static int lua_loki_search_buffers(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    const char *pattern = luaL_checkstring(L, 1);
+    int flags = 0, max = 0;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "literal");
+        if (lua_toboolean(L, -1)) flags |= BSEARCH_LITERAL;
+        lua_getfield(L, 2, "icase");
+        if (lua_toboolean(L, -1)) flags |= BSEARCH_ICASE;
+        else if (!lua_isnil(L, -1)) flags |= BSEARCH_CASE;
+        lua_getfield(L, 2, "max");
+        if (lua_isnumber(L, -1)) max = (int)lua_tointeger(L, -1);
+        lua_pop(L, 3);
+    }
+
+    BufferMatches bm;
+    const char *error;
+    if (bsearch_run(ctx, pattern, flags, max, &bm, &error) < 0) {
+        bsearch_matches_free(&bm);
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_createtable(L, bm.n, 0);
+    for (int i = 0; i < bm.n; i++) {
+        const BufferMatch *m = &bm.m[i];
+        editor_ctx_t *buf = m->buffer_id >= 0 ? buffer_get(m->buffer_id) : ctx;
+        const char *name = m->buffer_id >= 0 ? buffer_get_display_name(m->buffer_id)
+                                             : NULL;
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, m->buffer_id);
+        lua_setfield(L, -2, "buffer");
+        lua_pushstring(L, name ? name : "[No Name]");
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, m->row + 1);
+        lua_setfield(L, -2, "line");
+        lua_pushinteger(L, m->off + 1);
+        lua_setfield(L, -2, "col");
+        lua_pushinteger(L, m->len);
+        lua_setfield(L, -2, "len");
+        if (buf) {
+            t_erow *row = &buf->model.row[m->row];
+            lua_pushlstring(L, row->chars, (size_t)row->size);
+            lua_setfield(L, -2, "text");
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    bsearch_matches_free(&bm);
+    return 1;
+}
+
+/* ======================= Buffer Objects ======================= */
+
+/* loki.buffer([id]) - A handle on a buffer's rows that reads them in
+ * place: buf:line(), buf:lines() and buf:find() make a string only for
+ * what they return, and buf:slices() makes none. Rows are 0-indexed, as
+ * elsewhere in the loki API. The handle names the buffer, not its
+ * contents, so it sees edits made after it was taken; it raises an error
+ * once the buffer is closed. */
+
+#define LUA_BUFFER_MT "loki.buffer"
+
+/* Row pointer and length, as buf:slices() hands them out (declare it as
+ * typedef struct { const char *data; size_t len; } loki_slice_t for the
+ * LuaJIT FFI) */
+typedef struct {
+    const char *data;
+    size_t len;
+} lua_buffer_slice_t;
+
+typedef struct {
+    int buffer_id;                  /* -1: the editor context, no buffers */
+    editor_ctx_t *ctx;              /* When buffer_id is -1 */
+    lua_buffer_slice_t *slices;     /* Last buf:slices(), owned */
+    int nslices_cap;
+} lua_buffer_t;
+
+static editor_ctx_t *lua_buffer_ctx(lua_State *L, int idx) {
+    lua_buffer_t *b = luaL_checkudata(L, idx, LUA_BUFFER_MT);
+    editor_ctx_t *ctx = b->buffer_id >= 0 ? buffer_get(b->buffer_id) : b->ctx;
+    if (!ctx) luaL_error(L, "buffer %d is closed", b->buffer_id);
+    return ctx;
+}
+
+/* #buf - Rows */
+static int lua_buffer_len(lua_State *L) {
+    lua_pushinteger(L, lua_buffer_ctx(L, 1)->model.numrows);
+    return 1;
+}
+
+/* buf:line(row) - A row's text, nil past the end */
+static int lua_buffer_line(lua_State *L) {
+    editor_ctx_t *ctx = lua_buffer_ctx(L, 1);
+    lua_Integer row = luaL_checkinteger(L, 2);
+    if (row < 0 || row >= ctx->model.numrows) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const t_erow *er = &ctx->model.row[row];
+    lua_pushlstring(L, er->chars, (size_t)er->size);
+    return 1;
+}
+
+static int lua_buffer_lines_next(lua_State *L) {
+    editor_ctx_t *ctx = lua_buffer_ctx(L, lua_upvalueindex(1));
+    lua_Integer row = lua_tointeger(L, lua_upvalueindex(2));
+    lua_Integer last = lua_tointeger(L, lua_upvalueindex(3));
+    if (row > last || row >= ctx->model.numrows) return 0;
+    lua_pushinteger(L, row + 1);
+    lua_replace(L, lua_upvalueindex(2));
+    const t_erow *er = &ctx->model.row[row];
+    lua_pushinteger(L, row);
+    lua_pushlstring(L, er->chars, (size_t)er->size);
+    return 2;
+}
+
+/* buf:lines([first [, last]]) - Iterate row, text over rows first..last */
+static int lua_buffer_lines(lua_State *L) {
+    editor_ctx_t *ctx = lua_buffer_ctx(L, 1);
+    lua_Integer first = luaL_optinteger(L, 2, 0);
+    lua_Integer last = luaL_optinteger(L, 3, ctx->model.numrows - 1);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, first < 0 ? 0 : first);
+    lua_pushinteger(L, last);
+    lua_pushcclosure(L, lua_buffer_lines_next, 3);
+    return 1;
+}
+
+/* buf:find(pattern [, opts]) - loki.search() in this buffer */
+static int lua_buffer_find(lua_State *L) {
+    editor_ctx_t *ctx = lua_buffer_ctx(L, 1);
+    editor_ctx_t *cur = loki_lua_get_editor_context(L);
+    if (!cur || !cur->lua_host) return 0;
+    return lua_search_in(L, cur->lua_host, ctx, luaL_checkstring(L, 2), 3);
+}
+
+/* buf:slices([first [, count]]) - A pointer to an array of row pointer
+ * and length pairs (lua_buffer_slice_t) for rows first.., and how many.
+ * The array belongs to the handle; it and the rows it points at are
+ * valid until the buffer is edited or buf:slices() is called again. */
+static int lua_buffer_slices(lua_State *L) {
+    editor_ctx_t *ctx = lua_buffer_ctx(L, 1);
+    lua_buffer_t *b = lua_touserdata(L, 1);
+    lua_Integer first = luaL_optinteger(L, 2, 0);
+    if (first < 0) first = 0;
+    if (first > ctx->model.numrows) first = ctx->model.numrows;
+    lua_Integer count = luaL_optinteger(L, 3, ctx->model.numrows - first);
+    if (count < 0) count = 0;
+    if (count > ctx->model.numrows - first) count = ctx->model.numrows - first;
+
+    if (count > b->nslices_cap) {
+        lua_buffer_slice_t *slices = realloc(b->slices, sizeof(*slices) * (size_t)count);
+        if (!slices) {
+            perror("Out of memory");
+            exit(1);
+        }
+        b->slices = slices;
+        b->nslices_cap = (int)count;
+    }
+    for (lua_Integer i = 0; i < count; i++) {
+        const t_erow *er = &ctx->model.row[first + i];
+        b->slices[i].data = er->chars;
+        b->slices[i].len = (size_t)er->size;
+    }
+    lua_pushlightuserdata(L, b->slices);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static int lua_buffer_gc(lua_State *L) {
+    lua_buffer_t *b = luaL_checkudata(L, 1, LUA_BUFFER_MT);
+    free(b->slices);
+    b->slices = NULL;
+    b->nslices_cap = 0;
+    return 0;
+}
+
+static int lua_buffer_tostring(lua_State *L) {
+    lua_buffer_t *b = luaL_checkudata(L, 1, LUA_BUFFER_MT);
+    lua_pushfstring(L, "loki.buffer(%d)", b->buffer_id);
+    return 1;
+}
+
+static void lua_buffer_metatable(lua_State *L) {
+    if (!luaL_newmetatable(L, LUA_BUFFER_MT)) return;
+    static const struct {
+        const char *name;
+        lua_CFunction fn;
+    } methods[] = {
+        {"line", lua_buffer_line},
+        {"lines", lua_buffer_lines},
+        {"find", lua_buffer_find},
+        {"slices", lua_buffer_slices},
+    };
+    lua_newtable(L);
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        lua_pushcfunction(L, methods[i].fn);
+        lua_setfield(L, -2, methods[i].name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lua_buffer_tostring);
+    lua_setfield(L, -2, "__tostring");
+}
+
+/* Lua API: loki.buffer([id]) - A handle on a buffer (default: the current
+ * one), or nil if there is no such buffer */
+static int lua_loki_buffer(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    int id = buffer_get_current_id();
+    if (!lua_isnoneornil(L, 1)) {
+        id = (int)luaL_checkinteger(L, 1);
+        if (id < 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+    if (id >= 0 ? !buffer_get(id) : !ctx) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_buffer_t *b = lua_newuserdata(L, sizeof(lua_buffer_t));
+    b->buffer_id = id >= 0 ? id : -1;
+    b->ctx = id >= 0 ? NULL : ctx;
+    b->slices = NULL;
+    b->nslices_cap = 0;
+    lua_buffer_metatable(L);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
 /* Lua API: loki.get_lines() - Get total number of lines */
 static int lua_loki_get_lines(lua_State *L) {
     editor_ctx_t *ctx = loki_lua_get_editor_context(L);
     if (!ctx) return 0;
 
-    lua_pushinteger(L, ctx->model.numrows);
+    lua_pushinteger(L, ctx->model.numrows);
+    return 1;
+}
+
+/* Lua API: loki.ai_context([opts]) - Rows of the buffer as a JSON string
+ * (quoted and escaped) for an AI request body: opts.before and
+ * opts.after rows around the cursor (AI_CONTEXT_WINDOW each by
+ * default), the selected rows (opts.selection), the whole buffer
+ * (opts.all), or opts.ranges = {{first, last}, ...} (0-indexed), after
+ * opts.prefix. Rows are escaped once and cached; see ai_context.h. */
+static int lua_loki_ai_context(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx || !ctx->lua_host) return 0;
+    LuaHost *host = ctx->lua_host;
+    if (!host->ai_context && !(host->ai_context = ai_context_new()))
+        return luaL_error(L, "out of memory");
+
+    AiContextRange ranges[AI_CONTEXT_MAX_RANGES];
+    int nranges = 0, before = AI_CONTEXT_WINDOW, after = AI_CONTEXT_WINDOW;
+    const char *prefix = NULL;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "prefix");
+        if (lua_type(L, -1) == LUA_TSTRING) prefix = lua_tostring(L, -1);
+        lua_getfield(L, 1, "before");
+        if (lua_isnumber(L, -1)) before = (int)lua_tointeger(L, -1);
+        lua_getfield(L, 1, "after");
+        if (lua_isnumber(L, -1)) after = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);      /* The prefix stays on the stack until we return */
+
+        lua_getfield(L, 1, "ranges");
+        if (lua_istable(L, -1)) {
+            int n = (int)lua_rawlen(L, -1);
+            for (int i = 1; i <= n && nranges < AI_CONTEXT_MAX_RANGES; i++) {
+                lua_rawgeti(L, -1, i);
+                if (lua_istable(L, -1)) {
+                    lua_rawgeti(L, -1, 1);
+                    lua_rawgeti(L, -2, 2);
+                    ranges[nranges].first = (int)luaL_optinteger(L, -2, 0);
+                    ranges[nranges].last = (int)luaL_optinteger(L, -1, ranges[nranges].first);
+                    nranges++;
+                    lua_pop(L, 2);
+                }
+                lua_pop(L, 1);
+            }
+        }
+        lua_getfield(L, 1, "selection");
+        if (lua_toboolean(L, -1) && ctx->view.sel_active && nranges < AI_CONTEXT_MAX_RANGES) {
+            int a = ctx->view.sel_start_y, b = ctx->view.sel_end_y;
+            ranges[nranges].first = a < b ? a : b;
+            ranges[nranges].last = a < b ? b : a;
+            nranges++;
+        }
+        lua_getfield(L, 1, "all");
+        if (lua_toboolean(L, -1) && nranges < AI_CONTEXT_MAX_RANGES) {
+            ranges[nranges].first = 0;
+            ranges[nranges].last = ctx->model.numrows - 1;
+            nranges++;
+        }
+        lua_pop(L, 3);
+    }
+    if (nranges == 0) ranges[nranges++] = ai_context_window(ctx, before, after);
+
+    size_t len;
+    const char *json = ai_context_build(host->ai_context, &ctx->model, ranges, nranges,
+                                        prefix, &len);
+    lua_pushlstring(L, json, len);
+    return 1;
+}
+
+/* Lua API: loki.get_cursor() - Get cursor position (returns row, col)
+ * Returns FILE position, not screen position (accounts for scroll offset) */
+static int lua_loki_get_cursor(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    /* Return file position: screen pos + scroll offset */
+    lua_pushinteger(L, ctx->view.rowoff + ctx->view.cy);
+    lua_pushinteger(L, ctx->view.coloff + ctx->view.cx);
+    return 2;
+}
+
+/* Lua API: loki.insert_text(text) - Insert text at cursor */
+static int lua_loki_insert_text(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+
+    /* One edit, undone as one; newlines split the row */
+    editor_insert_text(ctx, text, len);
+    return 0;
+}
+
+/* Lua API: loki.delete_text(row, col, end_row, end_col) - Delete a range
+ * (0-indexed, end exclusive) in one edit, undone as one. The cursor goes
+ * to the start of the range. Returns the bytes deleted, newlines
+ * included. */
+static int lua_loki_delete_text(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    int row = (int)luaL_checkinteger(L, 1);
+    int col = (int)luaL_checkinteger(L, 2);
+    int end_row = (int)luaL_checkinteger(L, 3);
+    int end_col = (int)luaL_checkinteger(L, 4);
+    if (ctx->model.numrows == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    int deleted = editor_delete_range(ctx, row, col, end_row, end_col, &row, &col);
+    editor_cursor_to(ctx, row, col);
+    lua_pushinteger(L, deleted);
+    return 1;
+}
+
+/* Lua API: loki.pipe(cmd [, first, last]) - Filter rows first..last
+ * (0-indexed; all of them by default) through the shell command 'cmd', as
+ * :first,last!cmd does: the rows are replaced by its output as it comes,
+ * in one undo step. Returns true once it is started, or nil and the
+ * reason. */
+static int lua_loki_pipe(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    const char *cmd = luaL_checkstring(L, 1);
+    int first = (int)luaL_optinteger(L, 2, 0);
+    int last = (int)luaL_optinteger(L, 3, ctx->model.numrows - 1);
+    if (filter_start(ctx, first, last, cmd) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, ctx->view.statusmsg);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua API: loki.stream_text(text) - Append text and scroll to bottom */
+static int lua_loki_stream_text(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+
+    /* Move to end of file; inserting scrolls the view to it */
+    ctx->view.rowoff = 0;
+    ctx->view.coloff = 0;
+    ctx->view.cy = 0;
+    ctx->view.cx = 0;
+    if (ctx->model.numrows > 0) {
+        ctx->view.cy = ctx->model.numrows - 1;
+        ctx->view.cx = ctx->model.row[ctx->view.cy].size;
+    }
+
+    /* Insert the text in one edit. The main loop redraws on its next
+     * frame, so a burst of chunks costs one draw. */
+    editor_insert_text(ctx, text, len);
+    return 0;
+}
+
+/* Lua API: loki.ghost_show(text [, row, col]) - Show text as an inline
+ * suggestion at the cursor, or at 1-based row and 0-based col, in place
+ * of any shown. It is drawn, not inserted: see ghost.h. */
+static int lua_loki_ghost_show(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    if (!lua_isnoneornil(L, 2)) row = (int)luaL_checkinteger(L, 2) - 1;
+    if (!lua_isnoneornil(L, 3)) col = (int)luaL_checkinteger(L, 3);
+    ghost_show(ctx, row, col, text, len);
+    return 0;
+}
+
+/* Lua API: loki.ghost_append(text) - Add a streamed token to the
+ * suggestion shown (shown at the cursor if none); only its row is
+ * redrawn */
+static int lua_loki_ghost_append(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+    ghost_append(ctx, text, len);
+    return 0;
+}
+
+/* Lua API: loki.ghost_accept() - Insert the suggestion as one edit.
+ * Returns true if there was one. */
+static int lua_loki_ghost_accept(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    lua_pushboolean(L, ghost_accept(ctx));
+    return 1;
+}
+
+/* Lua API: loki.ghost_clear() - Drop the suggestion */
+static int lua_loki_ghost_clear(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    ghost_clear(ctx);
+    return 0;
+}
+
+/* Lua API: loki.ghost_text() - The suggestion shown, or nil */
+static int lua_loki_ghost_text(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    size_t len;
+    const char *text = ghost_text(ctx, &len);
+    if (text) lua_pushlstring(L, text, len);
+    else lua_pushnil(L);
+    return 1;
+}
+
+/* Lua API: loki.get_filename() - Get current filename */
+static int lua_loki_get_filename(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    if (ctx->model.filename) {
+        lua_pushstring(L, ctx->model.filename);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* Lua API: loki.memstats() - Row storage memory usage of the current buffer.
+ * Returns a table with row counts, arena usage in bytes and the number of
+ * allocator calls made for each kind of row buffer; with LOKI_MEMSTATS
+ * set, also 'subsystems': for each tag of memstats.h, its live bytes,
+ * their peak, and its allocations and frees. */
+static int lua_loki_memstats(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    ArenaStats as;
+    arena_get_stats(ctx->model.arena, &as);
+    const EditorAllocStats *st = &ctx->model.alloc_stats;
+
+    lua_newtable(L);
+    lua_pushinteger(L, ctx->model.numrows);
+    lua_setfield(L, -2, "rows");
+    lua_pushinteger(L, ctx->model.rowcap);
+    lua_setfield(L, -2, "row_capacity");
+    lua_pushinteger(L, (lua_Integer)as.chunks);
+    lua_setfield(L, -2, "arena_chunks");
+    lua_pushinteger(L, (lua_Integer)(as.chunk_bytes + as.large_bytes));
+    lua_setfield(L, -2, "arena_bytes");
+    lua_pushinteger(L, (lua_Integer)(as.used_bytes + as.large_bytes));
+    lua_setfield(L, -2, "used_bytes");
+    lua_pushinteger(L, (lua_Integer)as.free_bytes);
+    lua_setfield(L, -2, "free_bytes");
+    lua_pushinteger(L, (lua_Integer)as.large_blocks);
+    lua_setfield(L, -2, "large_blocks");
+    lua_pushinteger(L, (lua_Integer)st->row_array);
+    lua_setfield(L, -2, "row_array_allocs");
+    lua_pushinteger(L, (lua_Integer)st->chars);
+    lua_setfield(L, -2, "chars_allocs");
+    lua_pushinteger(L, (lua_Integer)st->render);
+    lua_setfield(L, -2, "render_allocs");
+    lua_pushinteger(L, (lua_Integer)st->hl);
+    lua_setfield(L, -2, "hl_allocs");
+
+    if (memstats_enabled()) {
+        lua_newtable(L);
+        for (int tag = 0; tag < MEM_TAGS; tag++) {
+            MemTagStats ms;
+            memstats_get((MemTag)tag, &ms);
+            lua_newtable(L);
+            lua_pushinteger(L, (lua_Integer)(ms.bytes > 0 ? ms.bytes : 0));
+            lua_setfield(L, -2, "bytes");
+            lua_pushinteger(L, (lua_Integer)ms.peak_bytes);
+            lua_setfield(L, -2, "peak_bytes");
+            lua_pushinteger(L, (lua_Integer)ms.allocs);
+            lua_setfield(L, -2, "allocs");
+            lua_pushinteger(L, (lua_Integer)ms.frees);
+            lua_setfield(L, -2, "frees");
+            lua_setfield(L, -2, memstats_tag_name((MemTag)tag));
+        }
+        lua_setfield(L, -2, "subsystems");
+    }
+    return 1;
+}
+
+/* Lua API: loki.queuestats() - Counters of the async event queue: its
+ * capacity, the most events it held at once, and the events queued,
+ * refused as full, dropped, coalesced and pushes that waited for room;
+ * or nil if there is no queue. */
+static int lua_loki_queuestats(lua_State *L) {
+    if (!async_queue_global()) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)st.capacity);
+    lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, (lua_Integer)st.high_water);
+    lua_setfield(L, -2, "high_water");
+    lua_pushinteger(L, (lua_Integer)async_queue_count(NULL));
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, (lua_Integer)st.pushed);
+    lua_setfield(L, -2, "pushed");
+    lua_pushinteger(L, (lua_Integer)st.rejected);
+    lua_setfield(L, -2, "rejected");
+    lua_pushinteger(L, (lua_Integer)st.dropped);
+    lua_setfield(L, -2, "dropped");
+    lua_pushinteger(L, (lua_Integer)st.coalesced);
+    lua_setfield(L, -2, "coalesced");
+    lua_pushinteger(L, (lua_Integer)st.blocked);
+    lua_setfield(L, -2, "blocked");
+    lua_pushinteger(L, (lua_Integer)st.payloads_reused);
+    lua_setfield(L, -2, "payloads_reused");
+    lua_pushinteger(L, (lua_Integer)st.payloads_allocated);
+    lua_setfield(L, -2, "payloads_allocated");
+    return 1;
+}
+
+static void push_hist_stats(lua_State *L, const AsyncHistStats *st) {
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)st->count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, (lua_Integer)st->mean);
+    lua_setfield(L, -2, "mean");
+    lua_pushinteger(L, (lua_Integer)st->p50);
+    lua_setfield(L, -2, "p50");
+    lua_pushinteger(L, (lua_Integer)st->p90);
+    lua_setfield(L, -2, "p90");
+    lua_pushinteger(L, (lua_Integer)st->p99);
+    lua_setfield(L, -2, "p99");
+    lua_pushinteger(L, (lua_Integer)st->max);
+    lua_setfield(L, -2, "max");
+}
+
+/* Lua API: loki.async_stats() - Where async event time goes: a table of
+ * 'depth' (events queued when each dispatch began) and 'types', which
+ * has for each event type dispatched, by name, its 'latency' (push to
+ * dispatch) and 'handler' run time. Each is a table of count, mean, p50,
+ * p90, p99 and max, in nanoseconds but for depth. nil without a queue. */
+static int lua_loki_async_stats(lua_State *L) {
+    if (!async_queue_global()) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    AsyncHistStats depth, latency, handler;
+    async_queue_get_depth_stats(NULL, &depth);
+
+    lua_newtable(L);
+    push_hist_stats(L, &depth);
+    lua_setfield(L, -2, "depth");
+    lua_pushinteger(L, (lua_Integer)async_queue_count(NULL));
+    lua_setfield(L, -2, "queued");
+
+    lua_newtable(L);
+    for (int type = ASYNC_EVENT_NONE + 1; type < ASYNC_EVENT_TYPE_COUNT; type++) {
+        if (async_queue_get_type_stats(NULL, (AsyncEventType)type, &latency, &handler) != 0)
+            continue;
+        lua_newtable(L);
+        lua_pushinteger(L, type);
+        lua_setfield(L, -2, "type");
+        push_hist_stats(L, &latency);
+        lua_setfield(L, -2, "latency");
+        push_hist_stats(L, &handler);
+        lua_setfield(L, -2, "handler");
+        const char *name = async_event_type_name((AsyncEventType)type);
+        if (strcmp(name, "USER") == 0) lua_rawseti(L, -2, type);
+        else lua_setfield(L, -2, name);
+    }
+    lua_setfield(L, -2, "types");
+    return 1;
+}
+
+/* Lua API: loki.gc_stats() - The collector's idle time schedule: the
+ * mode, idle periods that stepped it (idle_runs), steps, cycles they
+ * finished, their time (idle_ns, max_ns), input bursts it was stopped
+ * for, of those restarted past the growth limit (overflows), time it
+ * was stopped (paused_ns), KB allocated per idle period and the heap. */
+static int lua_loki_gc_stats(lua_State *L) {
+    LuaGcStats st;
+    lua_gc_get_stats(&st);
+
+    lua_newtable(L);
+    lua_pushstring(L, lua_gc_mode_name(lua_gc_get_mode()));
+    lua_setfield(L, -2, "mode");
+    lua_pushinteger(L, (lua_Integer)st.idle_runs);
+    lua_setfield(L, -2, "idle_runs");
+    lua_pushinteger(L, (lua_Integer)st.steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushinteger(L, (lua_Integer)st.cycles);
+    lua_setfield(L, -2, "cycles");
+    lua_pushinteger(L, (lua_Integer)st.idle_ns);
+    lua_setfield(L, -2, "idle_ns");
+    lua_pushinteger(L, (lua_Integer)st.max_ns);
+    lua_setfield(L, -2, "max_ns");
+    lua_pushinteger(L, (lua_Integer)st.bursts);
+    lua_setfield(L, -2, "bursts");
+    lua_pushinteger(L, (lua_Integer)st.overflows);
+    lua_setfield(L, -2, "overflows");
+    lua_pushinteger(L, (lua_Integer)st.paused_ns);
+    lua_setfield(L, -2, "paused_ns");
+    lua_pushnumber(L, st.rate_kb);
+    lua_setfield(L, -2, "alloc_kb");
+    lua_pushinteger(L, (lua_Integer)lua_gc(L, LUA_GCCOUNT, 0));
+    lua_setfield(L, -2, "heap_kb");
+    return 1;
+}
+
+/* Lua API: loki.open_many(files) - Open each file of the array in a
+ * buffer of its own, switch to the first and read the others in the
+ * background (see buffers_prefetch()). Returns an array of the buffer
+ * ids, in order, and an array of the files that could not be opened. */
+static int lua_loki_open_many(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = (int)lua_rawlen(L, 1);
+    int opened = 0, missing = 0, first = -1;
+
+    lua_newtable(L);    /* ids */
+    lua_newtable(L);    /* files not opened */
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        const char *file = lua_tostring(L, -1);
+        int id = file ? buffer_create(file) : -1;
+        if (id < 0) {
+            lua_rawseti(L, -2, ++missing);
+            continue;
+        }
+        lua_pop(L, 1);
+        lua_pushinteger(L, id);
+        lua_rawseti(L, -3, ++opened);
+        if (first < 0) first = id;
+    }
+    if (first >= 0) buffer_switch(first);
+    buffers_prefetch();
+    return 2;
+}
+
+/* Registry table of the functions of timers, by id */
+#define LUA_TIMERS_KEY "loki_timers"
+
+static void push_timers_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_TIMERS_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_TIMERS_KEY);
+    }
+}
+
+/* ASYNC_EVENT_TIMER handler: call the function of a Lua timer, or run
+ * CursorHold autocommands. Timers armed by other C code carry other
+ * userdata and are left alone. */
+static void lua_timer_handler(AsyncEvent *event, void *data) {
+    editor_ctx_t *ctx = (editor_ctx_t *)data;
+    if (autocmd_timer_fired(event->data.timer.userdata, ctx)) return;
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    int id = event->data.timer.timer_id;
+    if (!L || event->data.timer.userdata != (void *)L) return;
+
+    push_timers_table(L);
+    lua_rawgeti(L, -1, id);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+    /* A timeout is done once it fires */
+    if (!timer_service_pending(id)) {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, id);
+    }
+    lua_remove(L, -2);
+    if (lua_profile_pcall(L, LUA_PROFILE_TIMER, 0, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        editor_set_status_msg(ctx, "Timer error: %s", err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
+}
+
+static int add_lua_timer(lua_State *L, int repeat) {
+    lua_Integer ms = luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (ms < 0) ms = 0;
+
+    if (async_queue_get_handler(NULL, ASYNC_EVENT_TIMER) != lua_timer_handler)
+        async_queue_set_handler(NULL, ASYNC_EVENT_TIMER, lua_timer_handler);
+    int id = timer_service_add((uint64_t)ms, repeat ? (uint64_t)(ms > 0 ? ms : 1) : 0, L);
+    if (id < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Timers need the event queue");
+        return 2;
+    }
+
+    push_timers_table(L);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* Lua API: loki.set_timeout(ms, fn) - Call fn once, ms milliseconds from
+ * now, from the main loop. Returns the timer id, or nil and an error
+ * without the event queue. */
+static int lua_loki_set_timeout(lua_State *L) {
+    return add_lua_timer(L, 0);
+}
+
+/* Lua API: loki.set_interval(ms, fn) - Call fn every ms milliseconds from
+ * the main loop until loki.clear_timer(). Returns as loki.set_timeout(). */
+static int lua_loki_set_interval(lua_State *L) {
+    return add_lua_timer(L, 1);
+}
+
+/* Lua API: loki.clear_timer(id) - Stop a timer. Returns true if it was
+ * still to fire. */
+static int lua_loki_clear_timer(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    int armed = id > 0 && id <= INT32_MAX && timer_service_cancel((int)id) == 0;
+
+    push_timers_table(L);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushboolean(L, armed);
+    return 1;
+}
+
+/* Registry table of the callbacks of spawned jobs, by id: tables of
+ * 'done' and 'message' */
+#define LUA_WORKERS_KEY "loki_workers"
+
+static void push_workers_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_WORKERS_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_WORKERS_KEY);
+    }
+}
+
+/* LUA_WORKER_ASYNC_EVENT handler: hand a job's message or result to its
+ * callback. Replies for a state that has gone are dropped. */
+static void lua_worker_handler(AsyncEvent *event, void *data) {
+    editor_ctx_t *ctx = (editor_ctx_t *)data;
+    LuaWorkerReply *reply = event->data.user.ptr;
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    int id = (int)event->data.user.i64[0];
+    int kind = (int)event->data.user.i64[1];
+    if (!L || !reply || reply->owner != L) return;
+
+    push_workers_table(L);
+    lua_rawgeti(L, -1, id);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+    if (kind != LUA_WORKER_EVENT_MESSAGE) {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, id);
+    }
+    lua_getfield(L, -1, kind == LUA_WORKER_EVENT_MESSAGE ? "message" : "done");
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 3);
+        return;
+    }
+    int nargs = 0;
+    if (kind == LUA_WORKER_EVENT_ERROR) {
+        lua_pushnil(L);
+        nargs++;
+    }
+    nargs += lua_worker_decode(L, reply->data, reply->len);
+    if (lua_profile_pcall(L, LUA_PROFILE_WORKER, nargs, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        editor_set_status_msg(ctx, "Worker callback error: %s", err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+}
+
+/* Lua API: loki.spawn(code, args, [callback], [opts]) - Run code, a string
+ * of Lua or a function without upvalues, on a worker thread with args as
+ * its '...'. The worker sees a snapshot of the current buffer (or of
+ * opts.buffer, an id, or none if false) through loki.line(),
+ * loki.lines(), loki.line_count() and loki.filename(), and can send
+ * values to opts.on_message with loki.post(). callback gets what the code
+ * returned, or nil and the error. Values are copied between the states:
+ * nil, booleans, numbers, strings and tables of them. Returns the job id,
+ * or nil and an error. */
+static int lua_loki_spawn(lua_State *L) {
+    size_t len;
+    const char *source;
+    lua_settop(L, 4);
+    if (lua_isfunction(L, 1)) {
+        const char *name;
+        for (int i = 1; (name = lua_getupvalue(L, 1, i)) != NULL; i++) {
+            lua_pop(L, 1);
+            if (strcmp(name, "_ENV") != 0)
+                return luaL_error(L, "loki.spawn: function has upvalue '%s'; pass it in args", name);
+        }
+        /* string.dump(fn) */
+        lua_getglobal(L, "string");
+        lua_getfield(L, -1, "dump");
+        lua_remove(L, -2);
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 1, 0) != LUA_OK) return lua_error(L);
+        lua_replace(L, 1);
+    }
+    source = luaL_checklstring(L, 1, &len);
+    if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+    int has_opts = lua_istable(L, 4);
+
+    editor_ctx_t *buf = loki_lua_get_editor_context(L);
+    if (has_opts) {
+        lua_getfield(L, 4, "buffer");
+        if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) buf = NULL;
+        else if (!lua_isnil(L, -1)) buf = buffer_get((int)luaL_checkinteger(L, -1));
+        lua_pop(L, 1);
+    }
+
+    LuaWorkerValue args = {NULL, 0, 0};
+    if (!lua_isnoneornil(L, 2) && lua_worker_encode(L, 2, 1, &args) != 0) {
+        lua_worker_value_free(&args);
+        return luaL_error(L, "loki.spawn: args: %s", lua_tostring(L, -1));
+    }
+    LuaWorkerSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    if (buf) lua_worker_snapshot_take(buf, &snap);
+
+    if (async_queue_get_handler(NULL, LUA_WORKER_ASYNC_EVENT) != lua_worker_handler) {
+        async_queue_set_handler(NULL, LUA_WORKER_ASYNC_EVENT, lua_worker_handler);
+        async_event_set_type_name(LUA_WORKER_ASYNC_EVENT, "lua_worker");
+    }
+    const char *error = NULL;
+    int id = lua_worker_spawn(L, source, len, &args, &snap, &error);
+    if (id < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    push_workers_table(L);
+    lua_newtable(L);
+    lua_pushvalue(L, 3);
+    lua_setfield(L, -2, "done");
+    if (has_opts) {
+        lua_getfield(L, 4, "on_message");
+        lua_setfield(L, -2, "message");
+    }
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* Lua API: loki.read_file(path, callback) - Read a file on a worker
+ * thread; callback(text) gets its contents, or callback(nil, err).
+ * Returns the job id, or nil and an error. */
+static int lua_loki_read_file(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (async_queue_get_handler(NULL, LUA_WORKER_ASYNC_EVENT) != lua_worker_handler) {
+        async_queue_set_handler(NULL, LUA_WORKER_ASYNC_EVENT, lua_worker_handler);
+        async_event_set_type_name(LUA_WORKER_ASYNC_EVENT, "lua_worker");
+    }
+    const char *error = NULL;
+    int id = lua_worker_read_file(L, path, &error);
+    if (id < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    push_workers_table(L);
+    lua_newtable(L);
+    lua_pushvalue(L, 2);
+    lua_setfield(L, -2, "done");
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* Registry table of the functions of background jobs, by id: tables of
+ * 'stdout', 'stderr' and 'exit' */
+#define LUA_JOBS_KEY "loki_jobs"
+
+static void push_jobs_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_JOBS_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_JOBS_KEY);
+    }
+}
+
+/* Push the function 'name' of job 'id' over its jobs table and entry.
+ * Returns 1, or 0 with nothing pushed. */
+static int push_job_function(lua_State *L, int id, const char *name) {
+    push_jobs_table(L);
+    lua_rawgeti(L, -1, id);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_getfield(L, -1, name);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 3);
+        return 0;
+    }
+    return 1;
+}
+
+static void call_job_function(editor_ctx_t *ctx, lua_State *L, int nargs) {
+    if (lua_profile_pcall(L, LUA_PROFILE_JOB, nargs, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        editor_set_status_msg(ctx, "Job callback error: %s", err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
+}
+
+/* JobOutputFn of a job started from Lua: on_stdout/on_stderr(id, data).
+ * Output for a state that has gone is dropped. */
+static void lua_job_output(editor_ctx_t *ctx, int id, int stream, const char *data,
+                           size_t len, void *opaque) {
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    if (!L || L != opaque) return;
+    if (!push_job_function(L, id, stream == JOB_EVENT_STDOUT ? "stdout" : "stderr"))
+        return;
+    lua_pushinteger(L, id);
+    lua_pushlstring(L, data, len);
+    call_job_function(ctx, L, 2);
+    lua_pop(L, 2);
+}
+
+/* JobExitFn of a job started from Lua: on_exit(id, status, signal) */
+static void lua_job_exit(editor_ctx_t *ctx, int id, int64_t status, int term_signal,
+                         void *opaque) {
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    if (!L || L != opaque) return;
+    if (push_job_function(L, id, "exit")) {
+        lua_pushinteger(L, id);
+        lua_pushinteger(L, (lua_Integer)status);
+        lua_pushinteger(L, term_signal);
+        call_job_function(ctx, L, 3);
+        lua_pop(L, 1);
+    } else {
+        push_jobs_table(L);
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+}
+
+/* Lua API: loki.job_start(cmd, [opts]) - Run the shell command 'cmd' in
+ * the background. opts.on_stdout and opts.on_stderr get (id, data) for
+ * its output as it comes, in chunks, and opts.on_exit (id, status,
+ * signal) after the last of it. opts.buffer adds the output to a buffer
+ * as it comes, the view kept to its end: a buffer id, or true for a new
+ * one. opts.cwd is the directory to run it in. Returns the job id and
+ * the buffer's id if any, or nil and an error. */
+static int lua_loki_job_start(lua_State *L) {
+    const char *cmd = luaL_checkstring(L, 1);
+    int has_opts = lua_istable(L, 2);
+    JobSpec spec = { cmd, NULL, -1, lua_job_output, lua_job_exit, L };
+    if (has_opts) {
+        lua_getfield(L, 2, "cwd");
+        spec.cwd = lua_tostring(L, -1);     /* Kept by opts until started */
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "buffer");
+        if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
+            spec.buffer_id = buffer_create(NULL);
+            if (spec.buffer_id < 0) {
+                lua_pushnil(L);
+                lua_pushstring(L, "cannot open a buffer");
+                return 2;
+            }
+        } else if (!lua_isnoneornil(L, -1) && !lua_isboolean(L, -1)) {
+            spec.buffer_id = (int)luaL_checkinteger(L, -1);
+            editor_ctx_t *buf = buffer_get(spec.buffer_id);
+            if (buf == NULL) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "no buffer %d", spec.buffer_id);
+                return 2;
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    const char *error = NULL;
+    int id = job_start(&spec, &error);
+    if (id < 0) {
+        if (has_opts) {
+            lua_getfield(L, 2, "buffer");
+            if (lua_toboolean(L, -1) && lua_isboolean(L, -1))
+                buffer_close(spec.buffer_id, 1);     /* The new one */
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    push_jobs_table(L);
+    lua_newtable(L);
+    if (has_opts) {
+        lua_getfield(L, 2, "on_stdout");
+        lua_setfield(L, -2, "stdout");
+        lua_getfield(L, 2, "on_stderr");
+        lua_setfield(L, -2, "stderr");
+        lua_getfield(L, 2, "on_exit");
+        lua_setfield(L, -2, "exit");
+    }
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, id);
+    if (spec.buffer_id < 0) return 1;
+    lua_pushinteger(L, spec.buffer_id);
+    return 2;
+}
+
+/* Lua API: loki.job_stop(id) - Send a job's command SIGTERM; its on_exit
+ * still comes. Returns true, or false if it is not running. */
+static int lua_loki_job_stop(lua_State *L) {
+    lua_pushboolean(L, job_stop((int)luaL_checkinteger(L, 1)) == 0);
+    return 1;
+}
+
+/* ======================== Change watches ======================== */
+
+/* Registry table of the functions of loki.on_change() watches, by id */
+#define LUA_CHANGES_KEY "loki_changes"
+
+static void push_changes_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_CHANGES_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_CHANGES_KEY);
+    }
+}
+
+/* A watch of the state that made it, by id in LUA_CHANGES_KEY */
+typedef struct LuaChangeWatch {
+    lua_State *L;
+    int id;
+    int buffer_id;              /* The buffer it was made in */
+} LuaChangeWatch;
+
+/* ChangeFn of loki.on_change(): fn(changes, buffer_id), changes a list
+ * of {row, old, new, gen}, rows 0-indexed. A state that has gone is not
+ * called. */
+static void lua_change_batch(EditorModel *model, const ChangeRecord *records,
+                             int count, void *opaque) {
+    LuaChangeWatch *watch = opaque;
+    editor_ctx_t *ctx = buffer_get_current();
+    (void)model;
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    if (!L || L != watch->L) return;
+
+    push_changes_table(L);
+    lua_rawgeti(L, -1, watch->id);
+    lua_remove(L, -2);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, records[i].row);
+        lua_setfield(L, -2, "row");
+        lua_pushinteger(L, records[i].old_count);
+        lua_setfield(L, -2, "old");
+        lua_pushinteger(L, records[i].new_count);
+        lua_setfield(L, -2, "new");
+        lua_pushinteger(L, (lua_Integer)records[i].gen);
+        lua_setfield(L, -2, "gen");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, watch->buffer_id);
+    if (lua_profile_pcall(L, LUA_PROFILE_CHANGE, 2, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        editor_set_status_msg(ctx, "on_change error: %s", err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
+}
+
+/* Lua API: loki.on_change(fn [, ms]) - Call fn(changes, buffer_id) with
+ * the rows the current buffer's edits changed, batched: at the next
+ * frame, or ms milliseconds after the first edit of a batch. Each change
+ * is {row = first row, old = rows it replaced (-1: all), new = rows it
+ * holds, gen = edit number}, in order down the buffer. Returns the watch
+ * id. See changes.h. */
+static int lua_loki_on_change(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_Integer ms = luaL_optinteger(L, 2, 0);
+    if (!ctx) return 0;
+
+    LuaChangeWatch *watch = malloc(sizeof(LuaChangeWatch));
+    if (watch == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    watch->L = L;
+    watch->buffer_id = buffer_get_current_id();
+    watch->id = changes_watch(&ctx->model, ms > 0 && ms < INT32_MAX ? (int)ms : 0,
+                              lua_change_batch, free, watch);
+    push_changes_table(L);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, watch->id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, watch->id);
+    return 1;
+}
+
+/* Lua API: loki.off_change(id) - Stop a loki.on_change() watch. Returns
+ * true if it was watching. */
+static int lua_loki_off_change(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    int watching = id > 0 && id <= INT32_MAX && changes_unwatch((int)id) == 0;
+
+    push_changes_table(L);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushboolean(L, watching);
+    return 1;
+}
+
+/* ======================== Autocommands ======================== */
+
+/* Registry table of the functions of loki.autocmd() handlers, by id */
+#define LUA_AUTOCMDS_KEY "loki_autocmds"
+
+static void push_autocmds_table(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_AUTOCMDS_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_AUTOCMDS_KEY);
+    }
+}
+
+/* A handler of the state that added it, by id in LUA_AUTOCMDS_KEY */
+typedef struct LuaAutocmd {
+    lua_State *L;
+    int id;
+} LuaAutocmd;
+
+/* The id of the buffer of 'ctx', or 0 if it is not one yet */
+static int buffer_id_of(editor_ctx_t *ctx) {
+    for (int i = 0; i < buffer_count(); i++) {
+        int id = buffer_get_id_at(i);
+        if (buffer_peek(id, NULL) == ctx) return id;
+    }
+    return 0;
+}
+
+/* AutocmdFn of loki.autocmd(): fn({event, match, file, buffer}). A state
+ * that has gone is not called. */
+static void lua_autocmd_run(editor_ctx_t *ctx, AutocmdEvent event,
+                            const char *match, void *opaque) {
+    LuaAutocmd *handler = opaque;
+    editor_ctx_t *current = buffer_get_current();
+    lua_State *L = ctx_L(current ? current : ctx);
+    if (!L || L != handler->L) return;
+
+    push_autocmds_table(L);
+    lua_rawgeti(L, -1, handler->id);
+    lua_remove(L, -2);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, autocmd_event_name(event));
+    lua_setfield(L, -2, "event");
+    lua_pushstring(L, match);
+    lua_setfield(L, -2, "match");
+    if (ctx->model.filename) {
+        lua_pushstring(L, ctx->model.filename);
+        lua_setfield(L, -2, "file");
+    }
+    int id = buffer_id_of(ctx);
+    if (id > 0) {
+        lua_pushinteger(L, id);
+        lua_setfield(L, -2, "buffer");
+    }
+    if (lua_profile_pcall(L, LUA_PROFILE_AUTOCMD, 1, 0) != LUA_OK) {
+        const char *err = lua_tostring(L, -1);
+        editor_set_status_msg(current ? current : ctx, "%s autocommand error: %s",
+                              autocmd_event_name(event), err ? err : "unknown error");
+        lua_pop(L, 1);
+    }
+}
+
+/* The events of argument 'arg': a name, names separated by commas, or a
+ * list of names. 0, with a message pushed, if there is none or one is
+ * not an event. */
+static unsigned autocmd_events_arg(lua_State *L, int arg) {
+    unsigned events = 0;
+    char name[32];
+    if (lua_istable(L, arg)) {
+        int n = (int)lua_rawlen(L, arg);
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, arg, i);
+            const char *s = lua_tostring(L, -1);
+            int ev = s ? autocmd_event_by_name(s) : -1;
+            if (ev < 0) {
+                lua_pushfstring(L, "Unknown event: %s", s ? s : "?");
+                lua_remove(L, -2);
+                return 0;
+            }
+            lua_pop(L, 1);
+            events |= 1u << ev;
+        }
+    } else {
+        const char *s = luaL_checkstring(L, arg);
+        while (*s) {
+            size_t len = strcspn(s, ", ");
+            if (len > 0) {
+                snprintf(name, sizeof(name), "%.*s", (int)len, s);
+                int ev = len < sizeof(name) ? autocmd_event_by_name(name) : -1;
+                if (ev < 0) {
+                    lua_pushfstring(L, "Unknown event: %s", name);
+                    return 0;
+                }
+                events |= 1u << ev;
+            }
+            s += len;
+            if (*s) s++;
+        }
+    }
+    if (events == 0) lua_pushstring(L, "No event");
+    return events;
+}
+
+/* Lua API: loki.autocmd(events, [pattern,] fn) - Call fn(info) on the
+ * events ("BufRead", "BufWrite", "InsertLeave", "CursorHold", "FileType";
+ * several as "BufRead,BufWrite" or a list) of buffers whose file name,
+ * or file type for FileType, matches the globs of pattern ("*.c,*.h";
+ * "*" if left out). info is {event, match, file, buffer}. Returns the
+ * handler id, or nil and a message. See autocmd.h. */
+static int lua_loki_autocmd(lua_State *L) {
+    int fn = lua_gettop(L) >= 3 ? 3 : 2;
+    const char *pattern = fn == 3 ? luaL_checkstring(L, 2) : NULL;
+    luaL_checktype(L, fn, LUA_TFUNCTION);
+    unsigned events = autocmd_events_arg(L, 1);
+    if (events == 0) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    /* CursorHold comes by a timer */
+    if (async_queue_get_handler(NULL, ASYNC_EVENT_TIMER) != lua_timer_handler)
+        async_queue_set_handler(NULL, ASYNC_EVENT_TIMER, lua_timer_handler);
+
+    LuaAutocmd *handler = malloc(sizeof(LuaAutocmd));
+    if (handler == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    handler->L = L;
+    handler->id = autocmd_add(events, pattern, lua_autocmd_run, free, handler);
+    push_autocmds_table(L);
+    lua_pushvalue(L, fn);
+    lua_rawseti(L, -2, handler->id);
+    lua_pop(L, 1);
+    lua_pushinteger(L, handler->id);
     return 1;
 }
 
-/* Lua API: loki.get_cursor() - Get cursor position (returns row, col)
- * Returns FILE position, not screen position (accounts for scroll offset) */
-static int lua_loki_get_cursor(lua_State *L) {
-    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
-    if (!ctx) return 0;
+/* Lua API: loki.autocmd_del(id) - Remove a loki.autocmd() handler.
+ * Returns true if there was one. */
+static int lua_loki_autocmd_del(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    int removed = id > 0 && id <= INT32_MAX && autocmd_del((int)id) == 0;
 
-    /* Return file position: screen pos + scroll offset */
-    lua_pushinteger(L, ctx->view.rowoff + ctx->view.cy);
-    lua_pushinteger(L, ctx->view.coloff + ctx->view.cx);
-    return 2;
+    push_autocmds_table(L);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    lua_pushboolean(L, removed);
+    return 1;
 }
 
-/* Lua API: loki.insert_text(text) - Insert text at cursor */
-static int lua_loki_insert_text(lua_State *L) {
+/* ======================== Language servers ======================== */
+
+/* A function waiting for a language server's answer, referenced from the
+ * registry of the state that asked */
+typedef struct LuaLspCall {
+    lua_State *L;
+    int ref;
+} LuaLspCall;
+
+/* LspResultFn of loki.lsp_complete() and lsp_hover(). A request that was
+ * cancelled, or asked by a state that has gone, calls nothing. */
+static void lua_lsp_result(editor_ctx_t *ctx, const LspResult *result, void *opaque) {
+    LuaLspCall *call = opaque;
+    lua_State *L = ctx ? ctx_L(ctx) : NULL;
+    if (L && L == call->L) {
+        if (result->cancelled) {
+            luaL_unref(L, LUA_REGISTRYINDEX, call->ref);
+        } else {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, call->ref);
+            luaL_unref(L, LUA_REGISTRYINDEX, call->ref);
+            if (result->kind == LSP_REQ_HOVER) {
+                if (result->text) lua_pushstring(L, result->text);
+                else lua_pushnil(L);
+            } else {
+                lua_createtable(L, result->count, 0);
+                for (int i = 0; i < result->count; i++) {
+                    const LspItem *item = &result->items[i];
+                    lua_createtable(L, 0, 3);
+                    lua_pushstring(L, item->label);
+                    lua_setfield(L, -2, "label");
+                    if (item->detail) {
+                        lua_pushstring(L, item->detail);
+                        lua_setfield(L, -2, "detail");
+                    }
+                    lua_pushstring(L, item->insert);
+                    lua_setfield(L, -2, "insert");
+                    lua_rawseti(L, -2, i + 1);
+                }
+            }
+            if (lua_profile_pcall(L, LUA_PROFILE_LSP, 1, 0) != LUA_OK) {
+                const char *err = lua_tostring(L, -1);
+                editor_set_status_msg(ctx, "Language server callback error: %s",
+                                      err ? err : "unknown error");
+                lua_pop(L, 1);
+            }
+        }
+    }
+    free(call);
+}
+
+/* Lua API: loki.lsp_start(cmd) - Open the buffer's file in the language
+ * server run by cmd, started unless a buffer uses it already. Returns
+ * true, or nil and an error. */
+static int lua_loki_lsp_start(lua_State *L) {
     editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    const char *cmd = luaL_checkstring(L, 1);
     if (!ctx) return 0;
-
-    const char *text = luaL_checkstring(L, 1);
-    for (const char *p = text; *p; p++) {
-        editor_insert_char(ctx, *p);
+    if (lsp_start(ctx, cmd) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, ctx->view.statusmsg);
+        return 2;
     }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua API: loki.lsp_stop() - Close the buffer's file in its server */
+static int lua_loki_lsp_stop(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (ctx) lsp_stop(&ctx->model);
     return 0;
 }
 
-/* Lua API: loki.stream_text(text) - Append text and scroll to bottom */
-static int lua_loki_stream_text(lua_State *L) {
+static int lsp_request_fn(lua_State *L, int kind) {
     editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    luaL_checktype(L, 1, LUA_TFUNCTION);
     if (!ctx) return 0;
+    LuaLspCall *call = malloc(sizeof(LuaLspCall));
+    if (call == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    call->L = L;
+    lua_pushvalue(L, 1);
+    call->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (lsp_request(ctx, kind, lua_lsp_result, call) == -1) {
+        luaL_unref(L, LUA_REGISTRYINDEX, call->ref);
+        free(call);
+        lua_pushnil(L);
+        lua_pushstring(L, "no language server");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    const char *text = luaL_checkstring(L, 1);
+/* Lua API: loki.lsp_complete(fn) - Ask the buffer's server for completions
+ * at the cursor: fn(items), each {label, detail, insert}, unless a newer
+ * request comes first. Returns true, or nil and an error. */
+static int lua_loki_lsp_complete(lua_State *L) {
+    return lsp_request_fn(L, LSP_REQ_COMPLETION);
+}
 
-    /* Move to end of file */
-    if (ctx->model.numrows > 0) {
-        ctx->view.cy = ctx->model.numrows - 1;
-        ctx->view.cx = ctx->model.row[ctx->view.cy].size;
+/* Lua API: loki.lsp_hover(fn) - The same for the hover text: fn(text), or
+ * fn(nil) if there is none */
+static int lua_loki_lsp_hover(lua_State *L) {
+    return lsp_request_fn(L, LSP_REQ_HOVER);
+}
+
+/* Lua API: loki.lsp_diagnostics() - The diagnostics last published for the
+ * buffer, each {row, col, end_row, end_col, severity, message} (0-based,
+ * the end exclusive) */
+static int lua_loki_lsp_diagnostics(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    const LspDiagnostic *diags = NULL;
+    int n = ctx ? lsp_diagnostics(&ctx->model, &diags) : 0;
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, diags[i].row);
+        lua_setfield(L, -2, "row");
+        lua_pushinteger(L, diags[i].col);
+        lua_setfield(L, -2, "col");
+        lua_pushinteger(L, diags[i].end_row);
+        lua_setfield(L, -2, "end_row");
+        lua_pushinteger(L, diags[i].end_col);
+        lua_setfield(L, -2, "end_col");
+        lua_pushinteger(L, diags[i].severity);
+        lua_setfield(L, -2, "severity");
+        lua_pushstring(L, diags[i].message);
+        lua_setfield(L, -2, "message");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/* ======================== Symbol index ======================== */
+
+/* Symbols loki.symbols() returns unless asked for another number */
+#define LUA_SYMBOLS_MAX 100
+
+/* Lua API: loki.symbols(query[, max]) - The definitions in the project
+ * (the directory the editor runs in) whose names start with 'query', in
+ * name order, at most 'max': an array of {name, kind, path, line}, kind
+ * "function", "type" or "heading", path relative to the project. Looked
+ * up in the index under .loki/, which is built in the background if
+ * there is none (then returns nil, "indexing"). */
+static int lua_loki_symbols(lua_State *L) {
+    const char *query = luaL_checkstring(L, 1);
+    lua_Integer max = luaL_optinteger(L, 2, LUA_SYMBOLS_MAX);
+    if (max < 1) max = 1;
+    if (max > 10000) max = 10000;
+    if (symbols_root() == NULL && symbols_open(".") != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "can't open the symbol index");
+        return 2;
     }
+    Symbol *found = malloc(sizeof(*found) * (size_t)max);
+    if (!found) return luaL_error(L, "out of memory");
+    int n = symbols_find(query, SYMBOLS_PREFIX, found, (int)max);
+    if (n <= 0 && symbols_busy()) {
+        free(found);
+        lua_pushnil(L);
+        lua_pushstring(L, "indexing");
+        return 2;
+    }
+    lua_createtable(L, n > 0 ? n : 0, 0);
+    for (int i = 0; i < n; i++) {
+        lua_createtable(L, 0, 4);
+        lua_pushlstring(L, found[i].name, (size_t)found[i].name_len);
+        lua_setfield(L, -2, "name");
+        lua_pushstring(L, symbols_kind_name(found[i].kind));
+        lua_setfield(L, -2, "kind");
+        lua_pushlstring(L, found[i].path, (size_t)found[i].path_len);
+        lua_setfield(L, -2, "path");
+        lua_pushinteger(L, found[i].line);
+        lua_setfield(L, -2, "line");
+        lua_rawseti(L, -2, i + 1);
+    }
+    free(found);
+    return 1;
+}
 
-    /* Insert the text */
-    for (const char *p = text; *p; p++) {
-        editor_insert_char(ctx, *p);
+/* ======================== File finder ======================== */
+
+/* Paths loki.find_files() returns unless asked for another number */
+#define LUA_FIND_FILES_MAX 50
+
+/* Lua API: loki.find_files(query[, max]) - The project's files (under the
+ * directory the editor runs in) best matching 'query' as a fuzzy
+ * subsequence, best first, at most 'max': an array of paths relative to
+ * the project. An empty query gives every file, shortest first. The list
+ * is cached under .loki/ and brought up to date in the background (while
+ * that runs with nothing cached, returns nil, "listing"). */
+static int lua_loki_find_files(lua_State *L) {
+    const char *query = luaL_checkstring(L, 1);
+    lua_Integer max = luaL_optinteger(L, 2, LUA_FIND_FILES_MAX);
+    if (max < 1) max = 1;
+    if (max > 10000) max = 10000;
+    if (finder_root() == NULL && finder_open(".") != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "can't list the project's files");
+        return 2;
     }
+    FinderMatch *found = malloc(sizeof(*found) * (size_t)max);
+    if (!found) return luaL_error(L, "out of memory");
+    int n = finder_find(query, found, (int)max);
+    if (n <= 0 && finder_busy() && finder_count() == 0) {
+        free(found);
+        lua_pushnil(L);
+        lua_pushstring(L, "listing");
+        return 2;
+    }
+    lua_createtable(L, n > 0 ? n : 0, 0);
+    for (int i = 0; i < n; i++) {
+        lua_pushlstring(L, found[i].path, (size_t)found[i].len);
+        lua_rawseti(L, -2, i + 1);
+    }
+    free(found);
+    return 1;
+}
 
-    /* Scroll to bottom */
-    if (ctx->model.numrows > ctx->view.screenrows) {
-        ctx->view.rowoff = ctx->model.numrows - ctx->view.screenrows;
+/* ======================== Coroutines ======================== */
+
+/* Where an await is, in its state table's 'state' */
+#define AWAIT_STARTING 0    /* The operation is being started */
+#define AWAIT_WAITING 1     /* The coroutine has yielded for it */
+#define AWAIT_DONE 2        /* Resumed, or answered while starting */
+
+/* Resume 'co' with the 'nargs' values on top of its stack. An error ends
+ * the coroutine and is shown in the status bar. Returns 1 if it yielded. */
+static int resume_coroutine(lua_State *L, lua_State *co, int nargs) {
+#if LUA_VERSION_NUM >= 504
+    int nres = 0;
+    int rc = lua_resume(co, L, nargs, &nres);
+#elif LUA_VERSION_NUM >= 502
+    int rc = lua_resume(co, L, nargs);
+    int nres = lua_gettop(co);
+#else
+    int rc = lua_resume(co, nargs);
+    int nres = lua_gettop(co);
+#endif
+    if (rc == LUA_OK || rc == LUA_YIELD) {
+        lua_pop(co, nres);
+        return rc == LUA_YIELD;
     }
-    ctx->view.cy = ctx->model.numrows - 1;
+    const char *err = lua_tostring(co, -1);
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (ctx) editor_set_status_msg(ctx, "Async error: %s", err ? err : "unknown error");
+    else fprintf(stderr, "Async error: %s\n", err ? err : "unknown error");
+    lua_pop(co, 1);
+    return 0;
+}
 
-    /* Refresh screen immediately */
-    editor_refresh_screen(ctx);
+/* The callback an await hands its operation: resumes the coroutine
+ * (upvalue 1) with its arguments, once. Called before the coroutine has
+ * yielded, it leaves them in the state table (upvalue 2) instead. */
+static int lua_await_resume(lua_State *L) {
+    int n = lua_gettop(L);
+    int st = lua_upvalueindex(2);
+    lua_getfield(L, st, "state");
+    int state = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (state == AWAIT_DONE) return 0;
+
+    lua_pushinteger(L, AWAIT_DONE);
+    lua_setfield(L, st, "state");
+    if (state == AWAIT_STARTING) {
+        lua_createtable(L, n, 0);
+        for (int i = 1; i <= n; i++) {
+            lua_pushvalue(L, i);
+            lua_rawseti(L, -2, i);
+        }
+        lua_setfield(L, st, "values");
+        lua_pushinteger(L, n);
+        lua_setfield(L, st, "n");
+        return 0;
+    }
 
+    lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+    if (!co || lua_status(co) != LUA_YIELD) return 0;
+    luaL_checkstack(co, n, "too many values to resume with");
+    lua_xmove(L, co, n);
+    resume_coroutine(L, co, n);
     return 0;
 }
 
-/* Lua API: loki.get_filename() - Get current filename */
-static int lua_loki_get_filename(lua_State *L) {
-    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
-    if (!ctx) return 0;
+/* Lua API: loki.await(fn, ...) - Inside loki.async(), call fn(..., resume)
+ * and wait for resume to be called: returns what it was called with.
+ * fn is any function taking a callback last, like loki.set_timeout,
+ * loki.read_file and loki.spawn, or an awaitable such as loki.http(opts)
+ * returns. */
+static int lua_loki_await(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+    if (lua_pushthread(L)) return luaL_error(L, "loki.await: not in a coroutine (see loki.async)");
+    lua_newtable(L);
+    lua_pushinteger(L, AWAIT_STARTING);
+    lua_setfield(L, -2, "state");
+    int st = lua_gettop(L);
+    lua_pushvalue(L, st - 1);
+    lua_pushvalue(L, st);
+    lua_pushcclosure(L, lua_await_resume, 2);
+    int resume = lua_gettop(L);
+
+    luaL_checkstack(L, nargs + 2, "too many arguments");
+    for (int i = 1; i <= nargs + 1; i++) lua_pushvalue(L, i);
+    lua_pushvalue(L, resume);
+    lua_call(L, nargs + 1, 0);
+
+    lua_getfield(L, st, "state");
+    int state = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (state == AWAIT_DONE) {
+        /* Called back at once */
+        lua_getfield(L, st, "n");
+        int n = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, st, "values");
+        luaL_checkstack(L, n, "too many values");
+        for (int i = 1; i <= n; i++) lua_rawgeti(L, -i, i);
+        return n;
+    }
+    lua_pushinteger(L, AWAIT_WAITING);
+    lua_setfield(L, st, "state");
+    return lua_yield(L, 0);
+}
 
-    if (ctx->model.filename) {
-        lua_pushstring(L, ctx->model.filename);
-    } else {
+/* Lua API: loki.async(fn, ...) - Run fn(...) as a coroutine that can
+ * loki.await(); it runs now up to its first wait, and on from the main
+ * loop as what it waits for comes. Errors go to the status bar. Returns
+ * the coroutine. */
+static int lua_loki_async(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int n = lua_gettop(L);
+    lua_State *co = lua_newthread(L);
+    luaL_checkstack(L, n, "too many arguments");
+    for (int i = 1; i <= n; i++) lua_pushvalue(L, i);
+    lua_xmove(L, co, n);
+    resume_coroutine(L, co, n - 1);
+    lua_settop(L, n + 1);
+    return 1;
+}
+
+/* Lua API: loki.sleep(ms) - Inside loki.async(), wait ms milliseconds */
+static int lua_loki_sleep(lua_State *L) {
+    luaL_checkinteger(L, 1);
+    lua_settop(L, 1);
+    lua_pushcfunction(L, lua_loki_set_timeout);
+    lua_insert(L, 1);
+    return lua_loki_await(L);
+}
+
+/* Lua API: loki.undostats([buffer]) - Undo history memory usage of the
+ * current buffer, or of the buffer with that id. Returns a table with the
+ * bytes held (total, of which shared and packed), the limit, the bytes of
+ * text, group, entry and packed group counts, and the undo and redo
+ * levels; or nil if there is no such buffer. */
+static int lua_loki_undostats(lua_State *L) {
+    editor_ctx_t *ctx = lua_isnoneornil(L, 1)
+        ? loki_lua_get_editor_context(L)
+        : buffer_get((int)luaL_checkinteger(L, 1));
+    if (!ctx) {
         lua_pushnil(L);
+        return 1;
+    }
+
+    undo_memory_stats_t st;
+    int undo_levels, redo_levels;
+    undo_get_memory_stats(ctx, &st);
+    undo_get_stats(ctx, &undo_levels, &redo_levels, NULL);
+
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)st.total);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)st.limit);
+    lua_setfield(L, -2, "limit");
+    lua_pushinteger(L, (lua_Integer)st.text);
+    lua_setfield(L, -2, "text_bytes");
+    lua_pushinteger(L, (lua_Integer)st.shared);
+    lua_setfield(L, -2, "shared_bytes");
+    lua_pushinteger(L, (lua_Integer)st.packed);
+    lua_setfield(L, -2, "packed_bytes");
+    lua_pushinteger(L, st.groups);
+    lua_setfield(L, -2, "groups");
+    lua_pushinteger(L, st.packed_groups);
+    lua_setfield(L, -2, "packed_groups");
+    lua_pushinteger(L, st.entries);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, undo_levels);
+    lua_setfield(L, -2, "undo_levels");
+    lua_pushinteger(L, redo_levels);
+    lua_setfield(L, -2, "redo_levels");
+    return 1;
+}
+
+/* Lua API: loki.stats([buffer]) - Lines, words and bytes of the current
+ * buffer, or of the buffer with that id, as a table; or nil if there is no
+ * such buffer. Kept as rows change, so cheap to call on every keystroke. */
+static int lua_loki_stats(lua_State *L) {
+    editor_ctx_t *ctx = lua_isnoneornil(L, 1)
+        ? loki_lua_get_editor_context(L)
+        : buffer_get((int)luaL_checkinteger(L, 1));
+    if (!ctx) {
+        lua_pushnil(L);
+        return 1;
     }
+
+    EditorCounts n = editor_model_counts(&ctx->model);
+    lua_newtable(L);
+    lua_pushinteger(L, n.lines);
+    lua_setfield(L, -2, "lines");
+    lua_pushinteger(L, (lua_Integer)n.words);
+    lua_setfield(L, -2, "words");
+    lua_pushinteger(L, (lua_Integer)n.bytes);
+    lua_setfield(L, -2, "bytes");
     return 1;
 }
 
@@ -206,79 +2087,313 @@ static int lua_loki_set_color(lua_State *L) {
     int g = lua_tointeger(L, -2);
     int b = lua_tointeger(L, -1);
 
-    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
-        return luaL_error(L, "RGB values must be 0-255");
+    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+        return luaL_error(L, "RGB values must be 0-255");
+    }
+
+    ctx->view.colors[hl].r = r;
+    ctx->view.colors[hl].g = g;
+    ctx->view.colors[hl].b = b;
+    syntax_colors_changed(ctx);
+
+    lua_pop(L, 3);
+    return 0;
+}
+
+/* Lua API: loki.set_theme(table) - Set multiple colors at once */
+static int lua_loki_set_theme(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    /* Iterate over theme table */
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        /* Key at -2, value at -1 */
+        if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE) {
+            const char *name = lua_tostring(L, -2);
+            int hl = color_name_to_hl(name);
+
+            if (hl >= 0) {
+                /* Get RGB from value table */
+                lua_getfield(L, -1, "r");  /* Stack: ... table, r */
+                lua_getfield(L, -2, "g");  /* Stack: ... table, r, g */
+                lua_getfield(L, -3, "b");  /* Stack: ... table, r, g, b */
+
+                if (lua_isnumber(L, -3) && lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
+                    int r = lua_tointeger(L, -3);
+                    int g = lua_tointeger(L, -2);
+                    int b = lua_tointeger(L, -1);
+
+                    if (r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255) {
+                        ctx->view.colors[hl].r = r;
+                        ctx->view.colors[hl].g = g;
+                        ctx->view.colors[hl].b = b;
+                        syntax_colors_changed(ctx);
+                    }
+                }
+                lua_pop(L, 3);
+            }
+        }
+        lua_pop(L, 1); /* Remove value, keep key for next iteration */
+    }
+
+    return 0;
+}
+
+/* A function deferred to idle time: its coroutine, in the registry */
+typedef struct LuaDeferred {
+    lua_State *L;
+    int ref;
+} LuaDeferred;
+
+/* Idle step: resume the coroutine with the milliseconds left */
+static int lua_deferred_step(void *arg, uint64_t deadline) {
+    LuaDeferred *d = arg;
+    lua_State *L = d->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, d->ref);
+    lua_State *co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    uint64_t now = uv_hrtime();
+    lua_pushnumber(co, now < deadline ? (double)(deadline - now) / 1e6 : 0.0);
+    /* It may have changed anything: have the screen looked at */
+    return (resume_coroutine(L, co, 1) ? IDLE_MORE : IDLE_DONE) | IDLE_DAMAGE;
+}
+
+static void lua_deferred_done(void *arg) {
+    LuaDeferred *d = arg;
+    luaL_unref(d->L, LUA_REGISTRYINDEX, d->ref);
+    free(d);
+}
+
+/* Lua API: loki.defer(fn) - Run fn from the main loop when it is idle,
+ * as a coroutine: each coroutine.yield() gives the editor back, and fn
+ * goes on the next time there is some, from where it stopped. fn gets
+ * the milliseconds left of the slice, as does each yield. Returns an id
+ * for loki.cancel_deferred(id). */
+static int lua_loki_defer(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    LuaDeferred *d = malloc(sizeof(*d));
+    if (!d) return luaL_error(L, "Out of memory");
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_xmove(L, co, 1);
+    d->L = L;
+    d->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushinteger(L, idle_add(L, lua_deferred_step, lua_deferred_done, d));
+    return 1;
+}
+
+/* Lua API: loki.cancel_deferred(id) - Stop a deferred function. Returns
+ * true if it had not finished. */
+static int lua_loki_cancel_deferred(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, id > 0 && id <= INT32_MAX && idle_cancel((int)id));
+    return 1;
+}
+
+/* =========================== Display Settings Lua API ======================== */
+
+/* Lua API: loki.line_numbers([enabled]) - Get or set line numbers display
+ * With no argument: returns current state (true/false)
+ * With boolean argument: sets line numbers on/off
+ * Example: loki.line_numbers(true) to enable, loki.line_numbers(false) to disable */
+static int lua_loki_line_numbers(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    /* If no arguments, return current state */
+    if (lua_gettop(L) == 0) {
+        lua_pushboolean(L, ctx->view.line_numbers);
+        return 1;
+    }
+
+    /* Set line numbers based on argument */
+    int enabled = lua_toboolean(L, 1);
+    ctx->view.line_numbers = enabled ? 1 : 0;
+
+    return 0;
+}
+
+/* Lua API: loki.ignorecase([enabled]) - Get or set :set ignorecase
+ * With no argument: returns current state (true/false) */
+static int lua_loki_ignorecase(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    if (lua_gettop(L) == 0) {
+        lua_pushboolean(L, ctx->view.ignore_case);
+        return 1;
+    }
+    ctx->view.ignore_case = lua_toboolean(L, 1) ? 1 : 0;
+    return 0;
+}
+
+/* Lua API: loki.smartcase([enabled]) - Get or set :set smartcase (with
+ * ignorecase, a query with upper case letters matches case exactly)
+ * With no argument: returns current state (true/false) */
+static int lua_loki_smartcase(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    if (lua_gettop(L) == 0) {
+        lua_pushboolean(L, ctx->view.smart_case);
+        return 1;
+    }
+    ctx->view.smart_case = lua_toboolean(L, 1) ? 1 : 0;
+    return 0;
+}
+
+/* Lua API: loki.render_on_demand([enabled]) - Get or set whether rows with
+ * TABs read from files are rendered when first shown rather than on load
+ * With no argument: returns current state (true/false) */
+static int lua_loki_render_on_demand(lua_State *L) {
+    if (lua_gettop(L) == 0) {
+        lua_pushboolean(L, editor_get_render_on_demand());
+        return 1;
+    }
+    editor_set_render_on_demand(lua_toboolean(L, 1));
+    return 0;
+}
+
+/* Lua API: loki.decorate(row, col, len, style [, group]) - Highlight chars
+ * [col, col+len) of a row (0-indexed) over its syntax highlight; the
+ * decoration moves with edits. 'style' is a name ("match") or an HL_*
+ * number, 'group' 1 to DECOR_GROUP_LUA_END-1 (default 1). Returns true if
+ * added */
+static int lua_loki_decorate(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    int row = (int)luaL_checkinteger(L, 1);
+    int col = (int)luaL_checkinteger(L, 2);
+    int len = (int)luaL_checkinteger(L, 3);
+    int style = lua_type(L, 4) == LUA_TSTRING
+              ? syntax_name_to_code(lua_tostring(L, 4))
+              : (int)luaL_checkinteger(L, 4);
+    int group = (int)luaL_optinteger(L, 5, DECOR_GROUP_LUA);
+    if (style < 0 || style > 255)
+        return luaL_argerror(L, 4, "unknown style");
+    if (group < DECOR_GROUP_LUA || group >= DECOR_GROUP_LUA_END)
+        return luaL_argerror(L, 5, "group out of range");
+
+    lua_pushboolean(L, editor_decorate(&ctx->model, group, row, col, len,
+                                       (unsigned char)style) == 0);
+    return 1;
+}
+
+/* Lua API: loki.clear_decorations([group]) - Remove the decorations of a
+ * group, or with no argument of every group loki.decorate() adds to */
+static int lua_loki_clear_decorations(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    if (lua_gettop(L) == 0) {
+        for (int g = DECOR_GROUP_LUA; g < DECOR_GROUP_LUA_END; g++)
+            editor_undecorate(&ctx->model, g);
+        return 0;
+    }
+    int group = (int)luaL_checkinteger(L, 1);
+    if (group < DECOR_GROUP_LUA || group >= DECOR_GROUP_LUA_END)
+        return luaL_argerror(L, 1, "group out of range");
+    editor_undecorate(&ctx->model, group);
+    return 0;
+}
+
+/* Lua API: loki.mark_set(row, col [, right_gravity]) - Add a mark at a
+ * position (0-indexed) that moves with the text as it is edited. With
+ * right_gravity, text inserted at the mark goes before it. Returns its id */
+static int lua_loki_mark_set(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    int row = (int)luaL_checkinteger(L, 1);
+    int col = (int)luaL_checkinteger(L, 2);
+    int id = editor_mark_add(&ctx->model, row, col, lua_toboolean(L, 3));
+    if (id < 0) return luaL_error(L, "cannot set mark at %d,%d", row, col);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* Lua API: loki.mark_get(id) - Current row, col of a mark, or nil if it
+ * was deleted (or the buffer reloaded) */
+static int lua_loki_mark_get(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
+
+    int row, col;
+    if (marks_get(ctx->model.marks, (int)luaL_checkinteger(L, 1), &row, &col) != 0) {
+        lua_pushnil(L);
+        return 1;
     }
+    lua_pushinteger(L, row);
+    lua_pushinteger(L, col);
+    return 2;
+}
 
-    ctx->view.colors[hl].r = r;
-    ctx->view.colors[hl].g = g;
-    ctx->view.colors[hl].b = b;
+/* Lua API: loki.mark_del(id) - Delete a mark */
+static int lua_loki_mark_del(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
 
-    lua_pop(L, 3);
+    marks_del(ctx->model.marks, (int)luaL_checkinteger(L, 1));
     return 0;
 }
 
-/* Lua API: loki.set_theme(table) - Set multiple colors at once */
-static int lua_loki_set_theme(lua_State *L) {
+/* Lua API: loki.fold(first, last [, open]) - Fold rows first..last
+ * (0-indexed), closed unless 'open'. Returns true, or false if the fold
+ * would cross another */
+static int lua_loki_fold(lua_State *L) {
     editor_ctx_t *ctx = loki_lua_get_editor_context(L);
     if (!ctx) return 0;
 
-    luaL_checktype(L, 1, LUA_TTABLE);
-
-    /* Iterate over theme table */
-    lua_pushnil(L);
-    while (lua_next(L, 1) != 0) {
-        /* Key at -2, value at -1 */
-        if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE) {
-            const char *name = lua_tostring(L, -2);
-            int hl = color_name_to_hl(name);
+    int first = (int)luaL_checkinteger(L, 1);
+    int last = (int)luaL_checkinteger(L, 2);
+    int ok = editor_fold_add(&ctx->model, first, last, !lua_toboolean(L, 3)) == 0;
+    if (ok) editor_view_fix(ctx);
+    lua_pushboolean(L, ok);
+    return 1;
+}
 
-            if (hl >= 0) {
-                /* Get RGB from value table */
-                lua_getfield(L, -1, "r");  /* Stack: ... table, r */
-                lua_getfield(L, -2, "g");  /* Stack: ... table, r, g */
-                lua_getfield(L, -3, "b");  /* Stack: ... table, r, g, b */
+/* Lua API: loki.fold_open(row), loki.fold_close(row) - Open or close the
+ * fold holding a row. Returns true if a fold changed */
+static int lua_loki_fold_open(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
 
-                if (lua_isnumber(L, -3) && lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
-                    int r = lua_tointeger(L, -3);
-                    int g = lua_tointeger(L, -2);
-                    int b = lua_tointeger(L, -1);
+    int changed = fold_open(ctx->model.folds, (int)luaL_checkinteger(L, 1));
+    lua_pushboolean(L, changed);
+    return 1;
+}
 
-                    if (r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255) {
-                        ctx->view.colors[hl].r = r;
-                        ctx->view.colors[hl].g = g;
-                        ctx->view.colors[hl].b = b;
-                    }
-                }
-                lua_pop(L, 3);
-            }
-        }
-        lua_pop(L, 1); /* Remove value, keep key for next iteration */
-    }
+static int lua_loki_fold_close(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
 
-    return 0;
+    int changed = fold_close(ctx->model.folds, (int)luaL_checkinteger(L, 1));
+    if (changed) editor_view_fix(ctx);
+    lua_pushboolean(L, changed);
+    return 1;
 }
 
-/* =========================== Display Settings Lua API ======================== */
-
-/* Lua API: loki.line_numbers([enabled]) - Get or set line numbers display
- * With no argument: returns current state (true/false)
- * With boolean argument: sets line numbers on/off
- * Example: loki.line_numbers(true) to enable, loki.line_numbers(false) to disable */
-static int lua_loki_line_numbers(lua_State *L) {
+/* Lua API: loki.fold_indent() - Replace the folds with one per indented
+ * block, closed. Returns how many */
+static int lua_loki_fold_indent(lua_State *L) {
     editor_ctx_t *ctx = loki_lua_get_editor_context(L);
     if (!ctx) return 0;
 
-    /* If no arguments, return current state */
-    if (lua_gettop(L) == 0) {
-        lua_pushboolean(L, ctx->view.line_numbers);
-        return 1;
-    }
+    lua_pushinteger(L, fold_from_indent(ctx));
+    editor_view_fix(ctx);
+    return 1;
+}
 
-    /* Set line numbers based on argument */
-    int enabled = lua_toboolean(L, 1);
-    ctx->view.line_numbers = enabled ? 1 : 0;
+/* Lua API: loki.fold_clear() - Remove every fold */
+static int lua_loki_fold_clear(lua_State *L) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    if (!ctx) return 0;
 
+    fold_clear(ctx->model.folds);
     return 0;
 }
 
@@ -390,7 +2505,7 @@ static int lua_ex_command_handler(editor_ctx_t *ctx, const char *args) {
 
     /* Call the Lua function with args */
     lua_pushstring(L, args ? args : "");
-    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+    if (lua_profile_pcall(L, LUA_PROFILE_COMMAND, 1, 1) != LUA_OK) {
         const char *error = lua_tostring(L, -1);
         editor_set_status_msg(ctx, "Error: %s", error);
         lua_pop(L, 2);  /* Pop error and table */
@@ -449,7 +2564,7 @@ static int lua_loki_register_ex_command(lua_State *L) {
 
     if (!success) {
         lua_pushnil(L);
-        lua_pushstring(L, "Failed to register command (already exists or registry full)");
+        lua_pushstring(L, "Failed to register command (already exists)");
         return 2;
     }
 
@@ -825,6 +2940,103 @@ static int lua_loki_register_language(lua_State *L) {
     return 1;
 }
 
+/* Registry table of declared languages: extension -> loader */
+#define DECLARED_LANGUAGES "loki_declared_languages"
+
+static lua_State *declared_L;   /* The state the loaders are in */
+
+/* Lua API: loki.declare_language(extensions, loader) - Declare a language
+ * without defining it. 'extensions' is an extension (".go") or an array of
+ * them, or "*" for any file no language matches; 'loader' is a function or
+ * the path of a Lua file, run the first time a file with one of them is
+ * opened, to loki.register_language() it. A function gets the extension
+ * (nil for a file without one). */
+static int lua_loki_declare_language(lua_State *L) {
+    luaL_argcheck(L, lua_isfunction(L, 2) || lua_type(L, 2) == LUA_TSTRING, 2,
+                  "function or file name expected");
+    if (declared_L && declared_L != L)
+        return luaL_error(L, "languages are already declared in another state");
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        lua_newtable(L);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, 1);
+        lua_replace(L, 1);
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, DECLARED_LANGUAGES);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, DECLARED_LANGUAGES);
+    }
+    int n = (int)lua_rawlen(L, 1);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        const char *ext = lua_tostring(L, -1);
+        if (!ext || !ext[0]) return luaL_error(L, "extensions must be strings");
+        if (ext[0] != '.' && strcmp(ext, "*") != 0) lua_pushfstring(L, ".%s", ext);
+        else lua_pushstring(L, ext);
+        lua_pushvalue(L, 2);
+        lua_rawset(L, -4);
+        lua_pop(L, 1);
+    }
+    declared_L = L;
+    loki_lang_registry_changed();   /* Files nothing matched may match now */
+    return 0;
+}
+
+int lua_declared_language_load(const char *filename) {
+    lua_State *L = declared_L;
+    if (!L || !filename) return 0;
+    const char *ext = strrchr(filename, '.');
+    int top = lua_gettop(L);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, DECLARED_LANGUAGES);
+    if (!lua_istable(L, -1)) {
+        lua_settop(L, top);
+        return 0;
+    }
+    if (ext) {
+        lua_pushstring(L, ext);
+        lua_rawget(L, -2);
+    } else {
+        lua_pushnil(L);
+    }
+    if (!lua_isnil(L, -1)) {
+        lua_pushstring(L, ext);     /* Loaded once, whatever it does */
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    } else {
+        lua_pop(L, 1);
+        lua_pushstring(L, "*");
+        lua_rawget(L, -2);
+    }
+    if (lua_isnil(L, -1)) {
+        lua_settop(L, top);
+        return 0;
+    }
+
+    unsigned long gen = loki_lang_generation();
+    int rc;
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        rc = lua_cache_loadfile(L, lua_tostring(L, -1));
+        if (rc == LUA_OK) rc = lua_profile_pcall(L, LUA_PROFILE_LANGUAGE, 0, 0);
+    } else {
+        if (ext) lua_pushstring(L, ext);
+        else lua_pushnil(L);
+        rc = lua_profile_pcall(L, LUA_PROFILE_LANGUAGE, 1, 0);
+    }
+    if (rc != LUA_OK) {
+        editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+        if (ctx) editor_set_status_msg(ctx, "Language loader error (%s): %s",
+                                       ext ? ext : filename, lua_tostring(L, -1));
+    }
+    lua_settop(L, top);
+    return loki_lang_generation() != gen;
+}
+
 static int lua_loki_status_stdout(lua_State *L) {
     const char *msg = luaL_checkstring(L, 1);
     if (msg && *msg) {
@@ -907,6 +3119,53 @@ static const char *mode_char_to_name(char mode) {
     }
 }
 
+/* Convert mode character to its LUA_KEYMAP_* index, or -1 */
+static int mode_char_to_index(char mode) {
+    switch (mode) {
+        case 'n': return LUA_KEYMAP_NORMAL;
+        case 'i': return LUA_KEYMAP_INSERT;
+        case 'v': return LUA_KEYMAP_VISUAL;
+        case 'c': return LUA_KEYMAP_COMMAND;
+        default: return -1;
+    }
+}
+
+/* The keymaps the editor dispatches from for this state, made on first
+ * use, or NULL when it has no host (the host's L is set only once
+ * bootstrap returns, so NULL there means this state is being set up) */
+static LuaKeymaps *host_keymaps(lua_State *L, int create) {
+    editor_ctx_t *ctx = loki_lua_get_editor_context(L);
+    LuaHost *host = ctx ? ctx->lua_host : NULL;
+    if (!host || (host->L && host->L != L)) return NULL;
+    if (!host->keymaps && create) {
+        host->keymaps = malloc(sizeof(LuaKeymaps));
+        if (!host->keymaps) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (int m = 0; m < LUA_KEYMAP_MODES; m++)
+            for (int k = 0; k < LUA_KEYMAP_KEYS; k++)
+                host->keymaps->refs[m][k] = LUA_NOREF;
+    }
+    return host->keymaps;
+}
+
+/* Point a mode's key at the function on top of the stack, popping it, or
+ * unmap it if that is nil */
+static void set_keymap_ref(lua_State *L, LuaKeymaps *maps, int mode, int keycode) {
+    if (!maps || keycode >= LUA_KEYMAP_KEYS) {
+        lua_pop(L, 1);
+        return;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, maps->refs[mode][keycode]);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        maps->refs[mode][keycode] = LUA_NOREF;
+    } else {
+        maps->refs[mode][keycode] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
 /* Ensure _loki_keymaps table and mode subtable exist */
 static void ensure_keymap_tables(lua_State *L, const char *mode_name) {
     /* Get or create _loki_keymaps */
@@ -955,15 +3214,22 @@ static int lua_loki_keymap(lua_State *L) {
 
     /* Register for each mode character */
     for (const char *m = modes; *m; m++) {
-        const char *mode_name = mode_char_to_name(*m);
-        if (!mode_name) {
+        if (!mode_char_to_name(*m)) {
             return luaL_error(L, "Invalid mode character: %c (use n/i/v/c)", *m);
         }
+    }
+    LuaKeymaps *maps = host_keymaps(L, 1);
+    for (const char *m = modes; *m; m++) {
+        const char *mode_name = mode_char_to_name(*m);
+
+        /* What the editor dispatches from */
+        lua_pushvalue(L, 3);
+        set_keymap_ref(L, maps, mode_char_to_index(*m), keycode);
 
         ensure_keymap_tables(L, mode_name);
         /* Stack: _loki_keymaps, mode_table */
 
-        /* Store callback: mode_table[keycode] = callback */
+        /* Also kept in mode_table[keycode], for scripts listing keymaps */
         lua_pushinteger(L, keycode);
         lua_pushvalue(L, 3);  /* Push callback function */
         lua_settable(L, -3);
@@ -997,10 +3263,14 @@ static int lua_loki_keyunmap(lua_State *L) {
         return luaL_error(L, "Invalid key notation: %s", key_notation);
     }
 
+    LuaKeymaps *maps = host_keymaps(L, 0);
     for (const char *m = modes; *m; m++) {
         const char *mode_name = mode_char_to_name(*m);
         if (!mode_name) continue;
 
+        lua_pushnil(L);
+        set_keymap_ref(L, maps, mode_char_to_index(*m), keycode);
+
         lua_getglobal(L, "_loki_keymaps");
         if (!lua_istable(L, -1)) {
             lua_pop(L, 1);
@@ -1042,6 +3312,8 @@ void loki_lua_bind_minimal(lua_State *L) {
 
     lua_pushcfunction(L, lua_loki_register_language);
     lua_setfield(L, -2, "register_language");
+    lua_pushcfunction(L, lua_loki_declare_language);
+    lua_setfield(L, -2, "declare_language");
 
     lua_newtable(L); /* storage for registered help */
     lua_setfield(L, -2, "__repl_help");
@@ -1069,18 +3341,111 @@ void loki_lua_bind_editor(lua_State *L) {
     lua_pushcfunction(L, lua_loki_get_lines);
     lua_setfield(L, -2, "get_lines");
 
+    lua_pushcfunction(L, lua_loki_ai_context);
+    lua_setfield(L, -2, "ai_context");
+
+    lua_pushcfunction(L, lua_loki_buffer);
+    lua_setfield(L, -2, "buffer");
+
+    lua_pushcfunction(L, lua_loki_search);
+    lua_setfield(L, -2, "search");
+
+    lua_pushcfunction(L, lua_loki_grep);
+    lua_setfield(L, -2, "grep");
+    lua_pushcfunction(L, lua_loki_search_buffers);
+    lua_setfield(L, -2, "search_buffers");
+
     lua_pushcfunction(L, lua_loki_get_cursor);
     lua_setfield(L, -2, "get_cursor");
 
     lua_pushcfunction(L, lua_loki_insert_text);
     lua_setfield(L, -2, "insert_text");
 
+    lua_pushcfunction(L, lua_loki_delete_text);
+    lua_setfield(L, -2, "delete_text");
+
     lua_pushcfunction(L, lua_loki_stream_text);
     lua_setfield(L, -2, "stream_text");
+    lua_pushcfunction(L, lua_loki_ghost_show);
+    lua_setfield(L, -2, "ghost_show");
+    lua_pushcfunction(L, lua_loki_ghost_append);
+    lua_setfield(L, -2, "ghost_append");
+    lua_pushcfunction(L, lua_loki_ghost_accept);
+    lua_setfield(L, -2, "ghost_accept");
+    lua_pushcfunction(L, lua_loki_ghost_clear);
+    lua_setfield(L, -2, "ghost_clear");
+    lua_pushcfunction(L, lua_loki_ghost_text);
+    lua_setfield(L, -2, "ghost_text");
+
+    lua_pushcfunction(L, lua_loki_pipe);
+    lua_setfield(L, -2, "pipe");
 
     lua_pushcfunction(L, lua_loki_get_filename);
     lua_setfield(L, -2, "get_filename");
 
+    lua_pushcfunction(L, lua_loki_memstats);
+    lua_setfield(L, -2, "memstats");
+    lua_pushcfunction(L, lua_loki_undostats);
+    lua_setfield(L, -2, "undostats");
+    lua_pushcfunction(L, lua_loki_stats);
+    lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, lua_loki_open_many);
+    lua_setfield(L, -2, "open_many");
+    lua_pushcfunction(L, lua_loki_queuestats);
+    lua_setfield(L, -2, "queuestats");
+    lua_pushcfunction(L, lua_loki_async_stats);
+    lua_setfield(L, -2, "async_stats");
+    lua_pushcfunction(L, lua_loki_gc_stats);
+    lua_setfield(L, -2, "gc_stats");
+    lua_pushcfunction(L, lua_loki_set_timeout);
+    lua_setfield(L, -2, "set_timeout");
+    lua_pushcfunction(L, lua_loki_set_interval);
+    lua_setfield(L, -2, "set_interval");
+    lua_pushcfunction(L, lua_loki_clear_timer);
+    lua_setfield(L, -2, "clear_timer");
+    lua_pushcfunction(L, lua_loki_defer);
+    lua_setfield(L, -2, "defer");
+    lua_pushcfunction(L, lua_loki_cancel_deferred);
+    lua_setfield(L, -2, "cancel_deferred");
+    lua_pushcfunction(L, lua_loki_spawn);
+    lua_setfield(L, -2, "spawn");
+    lua_pushcfunction(L, lua_loki_read_file);
+    lua_setfield(L, -2, "read_file");
+
+    lua_pushcfunction(L, lua_loki_job_start);
+    lua_setfield(L, -2, "job_start");
+
+    lua_pushcfunction(L, lua_loki_job_stop);
+    lua_setfield(L, -2, "job_stop");
+    lua_pushcfunction(L, lua_loki_on_change);
+    lua_setfield(L, -2, "on_change");
+    lua_pushcfunction(L, lua_loki_off_change);
+    lua_setfield(L, -2, "off_change");
+    lua_pushcfunction(L, lua_loki_autocmd);
+    lua_setfield(L, -2, "autocmd");
+    lua_pushcfunction(L, lua_loki_autocmd_del);
+    lua_setfield(L, -2, "autocmd_del");
+    lua_pushcfunction(L, lua_loki_lsp_start);
+    lua_setfield(L, -2, "lsp_start");
+    lua_pushcfunction(L, lua_loki_lsp_stop);
+    lua_setfield(L, -2, "lsp_stop");
+    lua_pushcfunction(L, lua_loki_lsp_complete);
+    lua_setfield(L, -2, "lsp_complete");
+    lua_pushcfunction(L, lua_loki_lsp_hover);
+    lua_setfield(L, -2, "lsp_hover");
+    lua_pushcfunction(L, lua_loki_lsp_diagnostics);
+    lua_setfield(L, -2, "lsp_diagnostics");
+    lua_pushcfunction(L, lua_loki_symbols);
+    lua_setfield(L, -2, "symbols");
+    lua_pushcfunction(L, lua_loki_find_files);
+    lua_setfield(L, -2, "find_files");
+    lua_pushcfunction(L, lua_loki_async);
+    lua_setfield(L, -2, "async");
+    lua_pushcfunction(L, lua_loki_await);
+    lua_setfield(L, -2, "await");
+    lua_pushcfunction(L, lua_loki_sleep);
+    lua_setfield(L, -2, "sleep");
+
     lua_pushcfunction(L, lua_loki_set_color);
     lua_setfield(L, -2, "set_color");
 
@@ -1091,6 +3456,45 @@ void loki_lua_bind_editor(lua_State *L) {
     lua_pushcfunction(L, lua_loki_line_numbers);
     lua_setfield(L, -2, "line_numbers");
 
+    lua_pushcfunction(L, lua_loki_ignorecase);
+    lua_setfield(L, -2, "ignorecase");
+
+    lua_pushcfunction(L, lua_loki_smartcase);
+    lua_setfield(L, -2, "smartcase");
+
+    lua_pushcfunction(L, lua_loki_render_on_demand);
+    lua_setfield(L, -2, "render_on_demand");
+
+    lua_pushcfunction(L, lua_loki_decorate);
+    lua_setfield(L, -2, "decorate");
+
+    lua_pushcfunction(L, lua_loki_clear_decorations);
+    lua_setfield(L, -2, "clear_decorations");
+
+    lua_pushcfunction(L, lua_loki_mark_set);
+    lua_setfield(L, -2, "mark_set");
+
+    lua_pushcfunction(L, lua_loki_mark_get);
+    lua_setfield(L, -2, "mark_get");
+
+    lua_pushcfunction(L, lua_loki_mark_del);
+    lua_setfield(L, -2, "mark_del");
+
+    lua_pushcfunction(L, lua_loki_fold);
+    lua_setfield(L, -2, "fold");
+
+    lua_pushcfunction(L, lua_loki_fold_open);
+    lua_setfield(L, -2, "fold_open");
+
+    lua_pushcfunction(L, lua_loki_fold_close);
+    lua_setfield(L, -2, "fold_close");
+
+    lua_pushcfunction(L, lua_loki_fold_indent);
+    lua_setfield(L, -2, "fold_indent");
+
+    lua_pushcfunction(L, lua_loki_fold_clear);
+    lua_setfield(L, -2, "fold_clear");
+
     /* Modal system functions */
     lua_pushcfunction(L, lua_loki_get_mode);
     lua_setfield(L, -2, "get_mode");
@@ -1106,6 +3510,8 @@ void loki_lua_bind_editor(lua_State *L) {
 
     lua_pushcfunction(L, lua_loki_register_language);
     lua_setfield(L, -2, "register_language");
+    lua_pushcfunction(L, lua_loki_declare_language);
+    lua_setfield(L, -2, "declare_language");
 
     /* Keybinding functions */
     lua_pushcfunction(L, lua_loki_keymap);
@@ -1154,7 +3560,8 @@ void loki_lua_bind_editor(lua_State *L) {
 }
 
 #ifdef LOKI_ENABLE_HTTP
-/* Bind HTTP API - adds loki.async_http */
+/* Bind HTTP API - adds loki.async_http, loki.http, loki.http_preconnect,
+ * loki.http_cache, loki.http_cancel and loki.http_stats */
 void loki_lua_bind_http(lua_State *L) {
     if (!L) return;
 
@@ -1167,6 +3574,21 @@ void loki_lua_bind_http(lua_State *L) {
     lua_pushcfunction(L, lua_loki_async_http);
     lua_setfield(L, -2, "async_http");
 
+    lua_pushcfunction(L, lua_loki_http);
+    lua_setfield(L, -2, "http");
+
+    lua_pushcfunction(L, lua_loki_http_preconnect);
+    lua_setfield(L, -2, "http_preconnect");
+
+    lua_pushcfunction(L, lua_loki_http_cache);
+    lua_setfield(L, -2, "http_cache");
+
+    lua_pushcfunction(L, lua_loki_http_cancel);
+    lua_setfield(L, -2, "http_cancel");
+
+    lua_pushcfunction(L, lua_loki_http_stats);
+    lua_setfield(L, -2, "http_stats");
+
     lua_setglobal(L, "loki");
 }
 #endif /* LOKI_ENABLE_HTTP */
@@ -1203,7 +3625,7 @@ int loki_lua_load_config(lua_State *L, const struct loki_lua_opts *opts) {
     }
 
     if (override && override[0] != '\0') {
-        if (luaL_dofile(L, override) != LUA_OK) {
+        if (lua_cache_dofile(L, override) != LUA_OK) {
             const char *err = lua_tostring(L, -1);
             loki_lua_report(opts, "Lua init error (%s): %s", override, err ? err : "unknown");
             lua_pop(L, 1);
@@ -1220,7 +3642,7 @@ int loki_lua_load_config(lua_State *L, const struct loki_lua_opts *opts) {
     }
 
     if (access(init_path, R_OK) == 0) {
-        if (luaL_dofile(L, init_path) != LUA_OK) {
+        if (lua_cache_dofile(L, init_path) != LUA_OK) {
             const char *err = lua_tostring(L, -1);
             loki_lua_report(opts, "Lua init error (%s): %s", init_path, err ? err : "unknown");
             lua_pop(L, 1);
@@ -1234,7 +3656,7 @@ int loki_lua_load_config(lua_State *L, const struct loki_lua_opts *opts) {
         if (home && home[0] != '\0') {
             snprintf(init_path, sizeof(init_path), "%s/" LOKI_CONFIG_DIR "/init.lua", home);
             if (access(init_path, R_OK) == 0) {
-                if (luaL_dofile(L, init_path) != LUA_OK) {
+                if (lua_cache_dofile(L, init_path) != LUA_OK) {
                     const char *err = lua_tostring(L, -1);
                     loki_lua_report(opts, "Lua init error (%s): %s", init_path, err ? err : "unknown");
                     lua_pop(L, 1);
@@ -1420,6 +3842,7 @@ lua_State *loki_lua_bootstrap(editor_ctx_t *ctx, const struct loki_lua_opts *opt
         loki_lua_report(&effective, "Failed to allocate Lua state");
         return NULL;
     }
+    memstats_lua_attach(L);
 
     /* Store editor context in Lua registry for retrieval by API functions */
     if (ctx) {
@@ -1469,6 +3892,7 @@ lua_State *loki_lua_bootstrap(editor_ctx_t *ctx, const struct loki_lua_opts *opt
     luaL_openlibs(L);
 #endif
     loki_lua_extend_path(L, &effective);
+    lua_cache_install_searcher(L);
 
     if (effective.bind_editor) {
         loki_lua_bind_editor(L);
@@ -1482,6 +3906,8 @@ lua_State *loki_lua_bootstrap(editor_ctx_t *ctx, const struct loki_lua_opts *opt
     }
 #endif
 
+    startup_mark("lua runtime");
+
     if (effective.load_config) {
         if (loki_lua_load_config(L, &effective) < 0) {
             /* Leave state usable even if config fails; errors already reported */
@@ -1489,6 +3915,7 @@ lua_State *loki_lua_bootstrap(editor_ctx_t *ctx, const struct loki_lua_opts *opt
     }
 
     loki_lua_install_namespaces(L);
+    startup_mark("lua config");
 
     return L;
 }
@@ -1622,6 +4049,12 @@ static const char *lua_repl_top_to_string(lua_State *L, size_t *len) {
 #endif
 }
 
+/* The input history, opened when first used */
+static HistoryLog *lua_repl_history(t_lua_repl *repl) {
+    if (!repl->history) repl->history = history_open("lua");
+    return repl->history;
+}
+
 static void lua_repl_push_history(editor_ctx_t *ctx, const char *cmd) {
     t_lua_repl *repl = ctx_repl(ctx);
     if (!ctx || !repl || !cmd || !*cmd) return;
@@ -1635,34 +4068,16 @@ static void lua_repl_push_history(editor_ctx_t *ctx, const char *cmd) {
     }
     if (all_space) return;
 
-    if (repl->history_len == LUA_REPL_HISTORY_MAX) {
-        free(repl->history[0]);
-        memmove(repl->history, repl->history + 1,
-                sizeof(char*) * (LUA_REPL_HISTORY_MAX - 1));
-        repl->history_len--;
-    }
-
-    if (repl->history_len > 0) {
-        const char *last = repl->history[repl->history_len - 1];
-        if (last && strcmp(last, cmd) == 0) {
-            repl->history_index = -1;
-            return;
-        }
-    }
-
-    char *copy = strdup(cmd);
-    if (!copy) {
-        editor_set_status_msg(ctx, "Lua REPL: out of memory");
-        return;
-    }
-    repl->history[repl->history_len++] = copy;
+    /* Repeats of the last entry are not added */
+    HistoryLog *log = lua_repl_history(repl);
+    if (log && history_add(log, cmd) != 0)
+        editor_set_status_msg(ctx, "Lua REPL: history not saved");
     repl->history_index = -1;
 }
 
 static void lua_repl_history_apply(editor_ctx_t *ctx, t_lua_repl *repl) {
-    if (repl->history_index < 0 || repl->history_index >= repl->history_len)
-        return;
-    const char *src = repl->history[repl->history_index];
+    if (repl->history_index < 0 || !repl->history) return;
+    const char *src = history_get(repl->history, repl->history_index);
     if (!src) {
         lua_repl_clear_input(repl);
         return;
@@ -1679,6 +4094,28 @@ static void lua_repl_history_apply(editor_ctx_t *ctx, t_lua_repl *repl) {
     repl->input_len = (int)copy_len;
 }
 
+/* Ctrl-R: the next older entry starting with what was typed before the
+ * first Ctrl-R, skipping those already shown */
+static void lua_repl_history_search(editor_ctx_t *ctx, t_lua_repl *repl) {
+    HistoryLog *log = lua_repl_history(repl);
+    if (!log) return;
+    const char *shown = repl->history_index >= 0 ? history_get(log, repl->history_index) : NULL;
+    int from = repl->history_index + 1;
+    if (!shown || strcmp(shown, repl->input) != 0) {
+        /* Edited since: a new search, on what is there */
+        history_refresh(log);
+        repl->history_search_len = repl->input_len;
+        from = 0;
+    }
+    int age = history_find(log, repl->input, (size_t)repl->history_search_len, from);
+    if (age < 0) {
+        editor_set_status_msg(ctx, "Lua REPL: no older match");
+        return;
+    }
+    repl->history_index = age;
+    lua_repl_history_apply(ctx, repl);
+}
+
 static int lua_repl_input_has_content(const t_lua_repl *repl) {
     for (int i = 0; i < repl->input_len; i++) {
         if (!isspace((unsigned char)repl->input[i])) return 1;
@@ -1760,6 +4197,7 @@ static void lua_repl_execute_current(editor_ctx_t *ctx) {
 
     lua_repl_log_prefixed(ctx, LUA_REPL_PROMPT, repl->input);
     lua_repl_push_history(ctx, repl->input);
+    repl->completions_stale = 1;    /* It may define globals */
 
     const char *trim = repl->input;
     while (*trim && isspace((unsigned char)*trim)) trim++;
@@ -1782,7 +4220,7 @@ static void lua_repl_execute_current(editor_ctx_t *ctx) {
         return;
     }
 
-    int status = lua_pcall(L, 0, LUA_MULTRET, 0);
+    int status = lua_profile_pcall(L, LUA_PROFILE_REPL, 0, LUA_MULTRET);
     if (status != LUA_OK) {
         const char *err = lua_tostring(L, -1);
         lua_repl_log_prefixed(ctx, "! ", err ? err : "(unknown error)");
@@ -1863,36 +4301,30 @@ static int lua_repl_handle_builtin(editor_ctx_t *ctx, const char *cmd, size_t le
 
     if (lua_repl_iequals(cmd, len, "history")) {
         t_lua_repl *repl = ctx_repl(ctx);
-        if (!repl || repl->history_len == 0) {
+        HistoryLog *log = repl ? lua_repl_history(repl) : NULL;
+        if (log) history_refresh(log);
+        if (!log || history_count(log) == 0) {
             lua_repl_log_prefixed(ctx, "= ", "History is empty");
             return 1;
         }
         lua_repl_log_prefixed(ctx, "= ", "History (newest first):");
-        int start = repl->history_len - 1;
-        int shown = 0;
-        for (int i = start; i >= 0; i--) {
-            const char *entry = repl->history[i];
-            if (!entry) continue;
-            char buf[256];
-            snprintf(buf, sizeof(buf), "  %d: %s", repl->history_len - i, entry);
-            lua_repl_append_log(ctx, buf);
-            shown++;
-            if (shown >= 20) {
+        const char *entry;
+        for (int age = 0; (entry = history_get(log, age)) != NULL; age++) {
+            if (age >= 20) {
                 lua_repl_append_log(ctx, "  ...");
                 break;
             }
+            char buf[256];
+            snprintf(buf, sizeof(buf), "  %d: %s", age + 1, entry);
+            lua_repl_append_log(ctx, buf);
         }
         return 1;
     }
 
     if (lua_repl_iequals(cmd, len, "clear-history")) {
         t_lua_repl *repl = ctx_repl(ctx);
-        if (repl) {
-            for (int i = 0; i < repl->history_len; i++) {
-                free(repl->history[i]);
-                repl->history[i] = NULL;
-            }
-            repl->history_len = 0;
+        if (repl && lua_repl_history(repl)) {
+            history_clear(repl->history);
             repl->history_index = -1;
         }
         lua_repl_log_prefixed(ctx, "= ", "History cleared");
@@ -1910,7 +4342,86 @@ static int lua_repl_handle_builtin(editor_ctx_t *ctx, const char *cmd, size_t le
     return 0;
 }
 
-/* Tab completion for Lua identifiers */
+/* Add the string keys of the table at the top of the stack to the
+ * completion index, after 'prefix' and a dot if 'prefix' is not NULL */
+static void lua_repl_index_keys(lua_State *L, CompletionIndex *ix, const char *prefix, int source) {
+    char name[COMPLETION_WORD_MAX + 1];
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            const char *key = lua_tostring(L, -2);
+            int len = prefix ? snprintf(name, sizeof(name), "%s.%s", prefix, key)
+                             : snprintf(name, sizeof(name), "%s", key);
+            if (len > 0 && (size_t)len < sizeof(name))
+                completion_index_add(ix, name, (size_t)len, source);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/* Bring the console's completion index up to date: the loki.* bindings
+ * once, the other globals and the fields of tables among them after each
+ * line run, and the words of the buffer when it has changed. Each is a
+ * sync of its source, so the index changes only by what did. */
+static CompletionIndex *lua_repl_completions(editor_ctx_t *ctx, t_lua_repl *repl, lua_State *L) {
+    if (!repl->completions) {
+        repl->completions = completion_index_new();
+        repl->completions_stale = 1;
+        repl->completions_model = NULL;
+
+        completion_index_begin(repl->completions, COMPLETION_SOURCE_LOKI);
+        lua_getglobal(L, "loki");
+        if (lua_istable(L, -1)) lua_repl_index_keys(L, repl->completions, "loki", COMPLETION_SOURCE_LOKI);
+        lua_pop(L, 1);
+        completion_index_end(repl->completions, COMPLETION_SOURCE_LOKI);
+    }
+    CompletionIndex *ix = repl->completions;
+
+    if (repl->completions_stale) {
+        completion_index_begin(ix, COMPLETION_SOURCE_LUA);
+        lua_pushglobaltable(L);
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                size_t len;
+                const char *key = lua_tolstring(L, -2, &len);
+                completion_index_add(ix, key, len, COMPLETION_SOURCE_LUA);
+                if (lua_istable(L, -1) && strcmp(key, "loki") != 0)
+                    lua_repl_index_keys(L, ix, key, COMPLETION_SOURCE_LUA);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        completion_index_end(ix, COMPLETION_SOURCE_LUA);
+        repl->completions_stale = 0;
+    }
+
+    if (repl->completions_model != &ctx->model ||
+        repl->completions_gen != ctx->model.damage_gen) {
+        completion_index_begin(ix, COMPLETION_SOURCE_BUFFER);
+        for (int i = 0; i < ctx->model.numrows; i++) {
+            t_erow *row = &ctx->model.row[i];
+            completion_index_add_text(ix, row->chars, (size_t)row->size,
+                                      COMPLETION_SOURCE_BUFFER, LUA_REPL_BUFFER_WORD_MIN);
+        }
+        completion_index_end(ix, COMPLETION_SOURCE_BUFFER);
+        repl->completions_model = &ctx->model;
+        repl->completions_gen = ctx->model.damage_gen;
+    }
+    return ix;
+}
+
+/* Replace the word at 'word_start' with the 'len' bytes at 'text' */
+static void lua_repl_replace_word(t_lua_repl *repl, int word_start, const char *text, size_t len) {
+    if ((size_t)word_start + len >= KILO_QUERY_LEN) return;
+    memcpy(repl->input + word_start, text, len);
+    repl->input_len = word_start + (int)len;
+    repl->input[repl->input_len] = '\0';
+}
+
+/* Tab completion for Lua identifiers: a word the prefix picks out is
+ * completed, several to what they share and listed in the status line;
+ * with none, the best fuzzy matches are */
 static void lua_repl_complete_input(editor_ctx_t *ctx) {
     if (!ctx || !ctx_L(ctx)) return;
     t_lua_repl *repl = ctx_repl(ctx);
@@ -1923,7 +4434,7 @@ static void lua_repl_complete_input(editor_ctx_t *ctx) {
     int word_start = repl->input_len;
     while (word_start > 0) {
         char c = repl->input[word_start - 1];
-        if (!isalnum(c) && c != '_' && c != '.') break;
+        if (!isalnum((unsigned char)c) && c != '_' && c != '.') break;
         word_start--;
     }
 
@@ -1935,112 +4446,43 @@ static void lua_repl_complete_input(editor_ctx_t *ctx) {
     memcpy(prefix, repl->input + word_start, prefix_len);
     prefix[prefix_len] = '\0';
 
-    /* Handle table.field completion */
-    char *dot = strchr(prefix, '.');
-    char table_name[KILO_QUERY_LEN];
-    char field_prefix[KILO_QUERY_LEN];
-
-    if (dot) {
-        /* Split into table and field parts */
-        int table_len = dot - prefix;
-        memcpy(table_name, prefix, table_len);
-        table_name[table_len] = '\0';
-        strncpy(field_prefix, dot + 1, KILO_QUERY_LEN - 1);
-        field_prefix[KILO_QUERY_LEN - 1] = '\0';
-    } else {
-        table_name[0] = '\0';
-        strncpy(field_prefix, prefix, KILO_QUERY_LEN - 1);
-        field_prefix[KILO_QUERY_LEN - 1] = '\0';
-    }
-
-    /* Collect matches */
-    char matches[100][KILO_QUERY_LEN];
-    int match_count = 0;
-
-    lua_State *L = ctx_L(ctx);
+    CompletionIndex *ix = lua_repl_completions(ctx, repl, ctx_L(ctx));
 
-    if (table_name[0] != '\0') {
-        /* Table.field completion - look in specific table */
-        lua_getglobal(L, table_name);
-        if (lua_istable(L, -1)) {
-            lua_pushnil(L);
-            while (lua_next(L, -2) != 0 && match_count < 100) {
-                if (lua_type(L, -2) == LUA_TSTRING) {
-                    const char *key = lua_tostring(L, -2);
-                    if (strncmp(key, field_prefix, strlen(field_prefix)) == 0) {
-                        snprintf(matches[match_count++], KILO_QUERY_LEN, "%s.%s", table_name, key);
-                    }
-                }
-                lua_pop(L, 1);
-            }
-        }
-        lua_pop(L, 1);
-    } else {
-        /* Global completion - look in _G */
-        lua_pushglobaltable(L);
-        lua_pushnil(L);
-        while (lua_next(L, -2) != 0 && match_count < 100) {
-            if (lua_type(L, -2) == LUA_TSTRING) {
-                const char *key = lua_tostring(L, -2);
-                if (strncmp(key, field_prefix, strlen(field_prefix)) == 0) {
-                    strncpy(matches[match_count++], key, KILO_QUERY_LEN - 1);
-                }
-            }
-            lua_pop(L, 1);
-        }
-        lua_pop(L, 1);
+    int first;
+    size_t common;
+    int match_count = completion_index_prefix(ix, prefix, (size_t)prefix_len, &first, &common);
+    if (match_count == 1) {
+        /* Single match - complete it */
+        const char *word = completion_index_word(ix, first);
+        lua_repl_replace_word(repl, word_start, word, strlen(word));
+        return;
+    }
+    if (match_count > 1 && common > (size_t)prefix_len) {
+        /* Complete to common prefix */
+        lua_repl_replace_word(repl, word_start, completion_index_word(ix, first), common);
     }
 
-    /* Handle matches */
-    if (match_count == 0) {
-        /* No matches - do nothing */
+    /* Show the best matches in the status line */
+    const char *shown[LUA_REPL_COMPLETIONS_SHOWN];
+    int nshown = completion_index_query(ix, prefix, (size_t)prefix_len, shown,
+                                        LUA_REPL_COMPLETIONS_SHOWN);
+    if (nshown == 0) return;
+    if (match_count == 0 && nshown == 1) {
+        lua_repl_replace_word(repl, word_start, shown[0], strlen(shown[0]));
         return;
-    } else if (match_count == 1) {
-        /* Single match - complete it */
-        const char *completion = matches[0];
-        int completion_len = strlen(completion);
-        int space_needed = word_start + completion_len;
-
-        if (space_needed < KILO_QUERY_LEN) {
-            /* Replace the partial word with the completion */
-            memcpy(repl->input + word_start, completion, completion_len + 1);
-            repl->input_len = space_needed;
-        }
-    } else {
-        /* Multiple matches - find common prefix and show options */
-        int common_len = strlen(matches[0]);
-        for (int i = 1; i < match_count; i++) {
-            int j = 0;
-            while (j < common_len && matches[i][j] == matches[0][j]) {
-                j++;
-            }
-            common_len = j;
-        }
-
-        /* Complete to common prefix */
-        if (common_len > prefix_len) {
-            int space_needed = word_start + common_len;
-            if (space_needed < KILO_QUERY_LEN) {
-                memcpy(repl->input + word_start, matches[0], common_len);
-                repl->input_len = space_needed;
-                repl->input[repl->input_len] = '\0';
-            }
-        }
+    }
 
-        /* Show matches in status message */
-        char status[256] = "";
-        int status_len = 0;
-        for (int i = 0; i < match_count && i < 5; i++) {
-            if (i > 0) {
-                status_len += snprintf(status + status_len, sizeof(status) - status_len, ", ");
-            }
-            status_len += snprintf(status + status_len, sizeof(status) - status_len, "%s", matches[i]);
-        }
-        if (match_count > 5) {
-            snprintf(status + status_len, sizeof(status) - status_len, " ... (%d more)", match_count - 5);
-        }
-        editor_set_status_msg(ctx, "%s", status);
+    char status[256] = "";
+    int status_len = 0;
+    for (int i = 0; i < nshown && status_len < (int)sizeof(status); i++) {
+        status_len += snprintf(status + status_len, sizeof(status) - status_len,
+                               "%s%s", i > 0 ? ", " : "", shown[i]);
+    }
+    if (match_count > nshown && status_len < (int)sizeof(status)) {
+        snprintf(status + status_len, sizeof(status) - status_len, " ... (%d more)",
+                 match_count - nshown);
     }
+    editor_set_status_msg(ctx, "%s", status);
 }
 
 void lua_repl_handle_keypress(editor_ctx_t *ctx, int key) {
@@ -2070,27 +4512,26 @@ void lua_repl_handle_keypress(editor_ctx_t *ctx, int key) {
         repl->history_index = -1;
         return;
     case ARROW_UP:
-        if (repl->history_len > 0) {
-            if (repl->history_index == -1)
-                repl->history_index = repl->history_len - 1;
-            else if (repl->history_index > 0)
-                repl->history_index--;
+        if (!lua_repl_history(repl)) return;
+        /* Entries other processes added count from the first Up */
+        if (repl->history_index == -1) history_refresh(repl->history);
+        if (history_get(repl->history, repl->history_index + 1)) {
+            repl->history_index++;
             lua_repl_history_apply(ctx, repl);
         }
         return;
     case ARROW_DOWN:
-        if (repl->history_len > 0) {
-            if (repl->history_index == -1) {
-                return;
-            } else if (repl->history_index < repl->history_len - 1) {
-                repl->history_index++;
-                lua_repl_history_apply(ctx, repl);
-            } else {
-                repl->history_index = -1;
-                lua_repl_clear_input(repl);
-            }
+        if (repl->history_index > 0) {
+            repl->history_index--;
+            lua_repl_history_apply(ctx, repl);
+        } else if (repl->history_index == 0) {
+            repl->history_index = -1;
+            lua_repl_clear_input(repl);
         }
         return;
+    case CTRL_R:
+        lua_repl_history_search(ctx, repl);
+        return;
     case ENTER:
         lua_repl_execute_current(ctx);
         if (!repl->active) {
@@ -2115,14 +4556,13 @@ void lua_repl_handle_keypress(editor_ctx_t *ctx, int key) {
 }
 
 void lua_repl_free(t_lua_repl *repl) {
-    for (int i = 0; i < repl->history_len; i++) {
-        free(repl->history[i]);
-        repl->history[i] = NULL;
-    }
-    repl->history_len = 0;
+    history_close(repl->history);
+    repl->history = NULL;
     repl->history_index = -1;
 
     lua_repl_reset_log(repl);
+    completion_index_free(repl->completions);
+    repl->completions = NULL;
 }
 
 void lua_repl_init(t_lua_repl *repl) {
@@ -2145,7 +4585,16 @@ LuaHost *lua_host_create(void) {
 void lua_host_free(LuaHost *host) {
     if (!host) return;
     lua_repl_free(&host->repl);
+    lua_highlight_cache_free(host);
+    regexp_free(host->search_re);
+    free(host->search_src);
+    ai_context_free(host->ai_context);
+    free(host->keymaps);      /* Its references go with the state */
     if (host->L) {
+        idle_cancel_owner(host->L);
+        lua_profile_forget(host->L);
+        lua_gc_forget(host->L);
+        if (declared_L == host->L) declared_L = NULL;
         lua_close(host->L);
         host->L = NULL;
     }
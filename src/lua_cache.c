@@ -0,0 +1,278 @@
+/* lua_cache.c - Compiled Lua chunks kept on disk between runs
+ *
+ * See lua_cache.h for an overview. A cache file is a header naming what
+ * it was compiled from, then the bytecode:
+ *
+ *   LOKILUAC 1 <size> <mtime s> <mtime ns>\n<runtime>\n<absolute path>\n
+ *
+ * It is written aside and renamed over, so a reader never sees half of
+ * one. Loading compares the header with the one the source would have now,
+ * byte for byte.
+ */
+
+#define _DEFAULT_SOURCE     /* realpath() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <uv.h>
+#include <lauxlib.h>
+
+#include "lua_cache.h"
+#include "loki.h"
+#include "loki/lua.h"
+
+#define CACHE_MAGIC "LOKILUAC 1"
+#define CACHE_MAX_HEADER (PATH_MAX + 256)
+
+static LuaCacheStats stats;
+
+static int cache_enabled(void) {
+    const char *env = getenv("LOKI_LUA_CACHE");
+    return !(env && strcmp(env, "0") == 0);
+}
+
+/* ~/.loki/cache, created if missing (when ~/.loki exists) */
+static int cache_dir(char *buf, size_t size) {
+    const char *home = getenv("HOME");
+    struct stat st;
+    if (!home || !home[0]) return -1;
+    snprintf(buf, size, "%s/%s", home, LOKI_CONFIG_DIR);
+    if (stat(buf, &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    snprintf(buf, size, "%s/%s/cache", home, LOKI_CONFIG_DIR);
+    if (mkdir(buf, 0700) == -1 && errno != EEXIST) return -1;
+    return 0;
+}
+
+static long mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* The cache file for 'path' and the header it must start with. Returns
+ * the header's length, or -1 if the file can't be cached. */
+static int cache_entry(const char *path, char *file, size_t file_size,
+                       char *header, size_t header_size) {
+    char abs[PATH_MAX], dir[PATH_MAX];
+    struct stat st;
+    if (!cache_enabled() || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    if (!realpath(path, abs)) return -1;
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+
+    uint64_t h = 1469598103934665603ull;
+    for (const char *p = abs; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ull;
+    }
+    snprintf(file, file_size, "%s/lua-%016llx.luac", dir, (unsigned long long)h);
+
+    int n = snprintf(header, header_size, CACHE_MAGIC " %lld %lld %ld\n%s\n%s\n",
+                     (long long)st.st_size, (long long)st.st_mtime, mtime_ns(&st),
+                     loki_lua_runtime(), abs);
+    return n > 0 && (size_t)n < header_size ? n : -1;
+}
+
+/* Load the bytecode after 'header' in 'file' as a chunk named after
+ * 'path'. Returns LUA_OK with the chunk pushed, or -1 (nothing pushed). */
+static int load_cached(lua_State *L, const char *path, const char *file,
+                       const char *header, int header_len) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    char *data = NULL;
+    int rc = -1;
+    if (fstat(fd, &st) == 0 && st.st_size > header_len) {
+        size_t size = (size_t)st.st_size;
+        data = malloc(size);
+        if (!data) {
+            perror("Out of memory");
+            exit(1);
+        }
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = read(fd, data + got, size - got);
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (got == size && memcmp(data, header, (size_t)header_len) == 0) {
+            lua_pushfstring(L, "@%s", path);
+            const char *name = lua_tostring(L, -1);
+            rc = luaL_loadbuffer(L, data + header_len, size - (size_t)header_len, name);
+            lua_remove(L, -2);      /* The name */
+            if (rc != LUA_OK) {
+                lua_pop(L, 1);      /* A runtime that can't read it: rebuild */
+                rc = -1;
+            }
+        }
+    }
+    free(data);
+    close(fd);
+    return rc;
+}
+
+typedef struct {
+    char *data;
+    size_t size, capacity;
+} DumpBuffer;
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *ud) {
+    (void)L;
+    DumpBuffer *b = ud;
+    if (b->size + size > b->capacity) {
+        size_t cap = b->capacity ? b->capacity : 4096;
+        while (cap < b->size + size) cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            perror("Out of memory");
+            exit(1);
+        }
+        b->data = data;
+        b->capacity = cap;
+    }
+    memcpy(b->data + b->size, p, size);
+    b->size += size;
+    return 0;
+}
+
+/* Write the chunk on top of the stack to 'file' after 'header' */
+static void store(lua_State *L, const char *file, const char *header, int header_len) {
+    DumpBuffer b = {NULL, 0, 0};
+#if LUA_VERSION_NUM >= 503
+    int rc = lua_dump(L, dump_writer, &b, 0);
+#else
+    int rc = lua_dump(L, dump_writer, &b);
+#endif
+    if (rc != 0 || b.size == 0) {
+        free(b.data);
+        return;
+    }
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        FILE *f = fdopen(fd, "wb");
+        if (!f) {
+            close(fd);
+            unlink(tmp);
+        } else {
+            fwrite(header, 1, (size_t)header_len, f);
+            fwrite(b.data, 1, b.size, f);
+            if (fclose(f) != 0 || rename(tmp, file) != 0) unlink(tmp);
+            else stats.stores++;
+        }
+    }
+    free(b.data);
+}
+
+int lua_cache_loadfile(lua_State *L, const char *path) {
+    uint64_t start = uv_hrtime();
+    char file[PATH_MAX], header[CACHE_MAX_HEADER];
+    int header_len = cache_entry(path, file, sizeof(file), header, sizeof(header));
+
+    int rc = header_len > 0 ? load_cached(L, path, file, header, header_len) : -1;
+    if (rc == LUA_OK) {
+        stats.hits++;
+    } else {
+        rc = luaL_loadfile(L, path);
+        stats.misses++;
+        if (rc == LUA_OK && header_len > 0) store(L, file, header, header_len);
+    }
+    stats.load_ns += uv_hrtime() - start;
+    return rc;
+}
+
+int lua_cache_dofile(lua_State *L, const char *path) {
+    int rc = lua_cache_loadfile(L, path);
+    return rc != LUA_OK ? rc : lua_pcall(L, 0, LUA_MULTRET, 0);
+}
+
+/* package.path, with '?' as 'name' (dots as slashes), to the first file
+ * there is in 'buf'. Returns 0, or -1 if there is none. */
+static int search_path(lua_State *L, const char *name, char *buf, size_t size) {
+    lua_getglobal(L, "package");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return -1;
+    }
+    lua_getfield(L, -1, "path");
+    const char *path = lua_tostring(L, -1);
+    int found = -1;
+    for (const char *t = path; t && *t && found < 0; ) {
+        const char *end = strchr(t, ';');
+        size_t tlen = end ? (size_t)(end - t) : strlen(t);
+
+        size_t n = 0;
+        int fits = 1;
+        for (size_t i = 0; i < tlen && fits; i++) {
+            if (t[i] == '?') {
+                for (const char *c = name; *c && fits; c++) {
+                    if (n + 1 >= size) fits = 0;
+                    else buf[n++] = *c == '.' ? '/' : *c;
+                }
+            } else if (n + 1 >= size) {
+                fits = 0;
+            } else {
+                buf[n++] = t[i];
+            }
+        }
+        buf[n] = '\0';
+        if (fits && n > 0 && access(buf, R_OK) == 0) found = 0;
+        t = end ? end + 1 : t + tlen;
+    }
+    lua_pop(L, 2);
+    return found;
+}
+
+/* A package searcher: the module's file on package.path, loaded through
+ * the cache, and its path for the loader */
+static int cache_searcher(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    char path[PATH_MAX];
+    if (search_path(L, name, path, sizeof(path)) != 0) {
+        lua_pushnil(L);     /* The standard searchers say where they looked */
+        return 1;
+    }
+    if (lua_cache_loadfile(L, path) != LUA_OK) {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                          name, path, lua_tostring(L, -1));
+    }
+    lua_pushstring(L, path);
+    return 2;
+}
+
+void lua_cache_install_searcher(lua_State *L) {
+    lua_getglobal(L, "package");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, "searchers");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "loaders");        /* Lua 5.1, LuaJIT */
+    }
+    if (lua_istable(L, -1)) {
+        /* Second, after the preload searcher: before the Lua file one */
+        int n = (int)lua_rawlen(L, -1);
+        for (int i = n; i >= 2; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushcfunction(L, cache_searcher);
+        lua_rawseti(L, -2, 2);
+    }
+    lua_pop(L, 2);
+}
+
+void lua_cache_get_stats(LuaCacheStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,41 @@
+/* lua_cache.h - Compiled Lua chunks kept on disk between runs
+ *
+ * init.lua and the modules it requires are compiled when the editor
+ * starts. The bytecode cache keeps what compiling them produced (lua_dump)
+ * in ~/.loki/cache/lua-<hash>.luac, keyed by the file's absolute path, size
+ * and modification time and by the Lua runtime, so the next start loads
+ * the bytecode with luaL_loadbuffer instead of parsing the source. A
+ * cache file that doesn't match, or that the runtime refuses, is rebuilt
+ * from the source.
+ *
+ * The cache is used only when ~/.loki exists, and not at all with
+ * LOKI_LUA_CACHE=0 in the environment.
+ */
+
+#ifndef LOKI_LUA_CACHE_H
+#define LOKI_LUA_CACHE_H
+
+#include <stdint.h>
+#include <lua.h>
+
+typedef struct LuaCacheStats {
+    unsigned hits;          /* Chunks loaded from the cache */
+    unsigned misses;        /* Chunks compiled from source */
+    unsigned stores;        /* Cache files written */
+    uint64_t load_ns;       /* Time spent loading chunks, either way */
+} LuaCacheStats;
+
+/* Like luaL_loadfile(), through the cache. */
+int lua_cache_loadfile(lua_State *L, const char *path);
+
+/* Like luaL_dofile(), through the cache. */
+int lua_cache_dofile(lua_State *L, const char *path);
+
+/* Have require() load Lua modules found on package.path through the
+ * cache, ahead of the standard Lua file searcher. */
+void lua_cache_install_searcher(lua_State *L);
+
+/* Counters since the process started. */
+void lua_cache_get_stats(LuaCacheStats *stats);
+
+#endif /* LOKI_LUA_CACHE_H */
@@ -0,0 +1,153 @@
+/* lua_gc.c - Lua garbage collection in the editor's idle time
+ *
+ * See lua_gc.h for an overview. The heap's growth between idle periods
+ * stands for what Lua allocated (less whatever the automatic collector
+ * freed meanwhile); each idle period steps the collector as if that much
+ * was allocated, in steps sized to a running mean of it, until it is paid
+ * for, a cycle finishes, or the budget runs out. What is left is carried
+ * over to the next idle period.
+ */
+
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <string.h>
+#include <uv.h>
+
+#include "lua_gc.h"
+
+static LuaGcMode mode = LUA_GC_BURST;
+static size_t burst_limit = LUA_GC_BURST_LIMIT;
+static LuaGcStats stats;
+
+static struct {
+    lua_State *stopped;         /* State whose collector we stopped */
+    int overflowed;             /* It grew past the limit in this burst */
+    uint64_t stopped_at;
+    size_t stopped_kb;          /* Heap when it was stopped */
+    lua_State *last;            /* State of the last idle period */
+    size_t last_kb;             /* Its heap after it */
+    double debt_kb;             /* Allocation not paid for by steps yet */
+} gc;
+
+static size_t heap_kb(lua_State *L) {
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    return kb > 0 ? (size_t)kb : 0;
+}
+
+/* Start the collector we stopped again */
+static void restart(void) {
+    if (!gc.stopped) return;
+    lua_gc(gc.stopped, LUA_GCRESTART, 0);
+    stats.paused_ns += uv_hrtime() - gc.stopped_at;
+    gc.stopped = NULL;
+}
+
+void lua_gc_idle(lua_State *L, uint64_t budget_ns) {
+    restart();
+    gc.overflowed = 0;
+    if (!L || mode == LUA_GC_AUTO) return;
+
+    size_t kb = heap_kb(L);
+    if (L != gc.last) {
+        gc.last = L;
+        gc.last_kb = kb;
+        gc.debt_kb = 0;
+        return;
+    }
+    size_t grew = kb > gc.last_kb ? kb - gc.last_kb : 0;
+    gc.last_kb = kb;
+    if (grew == 0 && gc.debt_kb <= 0) return;
+
+    stats.rate_kb = stats.rate_kb * 0.875 + (double)grew * 0.125;
+    gc.debt_kb += (double)grew;
+    int step = stats.rate_kb < LUA_GC_STEP_MIN_KB ? LUA_GC_STEP_MIN_KB
+             : stats.rate_kb > LUA_GC_STEP_MAX_KB ? LUA_GC_STEP_MAX_KB
+             : (int)stats.rate_kb;
+
+    uint64_t start = uv_hrtime();
+    uint64_t deadline = start + (budget_ns ? budget_ns : LUA_GC_IDLE_BUDGET_NS);
+    do {
+        stats.steps++;
+        gc.debt_kb -= step;
+        if (lua_gc(L, LUA_GCSTEP, step)) {
+            stats.cycles++;             /* Nothing left to pay for */
+            gc.debt_kb = 0;
+            break;
+        }
+    } while (gc.debt_kb > 0 && uv_hrtime() < deadline);
+    uint64_t ns = uv_hrtime() - start;
+
+    stats.idle_runs++;
+    stats.idle_ns += ns;
+    if (ns > stats.max_ns) stats.max_ns = ns;
+    gc.last_kb = stats.heap_kb = heap_kb(L);
+}
+
+void lua_gc_input(lua_State *L) {
+    if (!L || mode != LUA_GC_BURST || burst_limit == 0) return;
+    if (gc.stopped) {
+        if (gc.stopped == L && heap_kb(L) > gc.stopped_kb + burst_limit / 1024) {
+            restart();
+            gc.overflowed = 1;
+            stats.overflows++;
+        }
+        return;
+    }
+    if (gc.overflowed) return;
+#ifdef LUA_GCISRUNNING
+    if (!lua_gc(L, LUA_GCISRUNNING, 0)) return;    /* collectgarbage("stop") */
+#endif
+    lua_gc(L, LUA_GCSTOP, 0);
+    gc.stopped = L;
+    gc.stopped_at = uv_hrtime();
+    gc.stopped_kb = heap_kb(L);
+    stats.bursts++;
+}
+
+void lua_gc_forget(lua_State *L) {
+    if (gc.stopped == L) restart();
+    if (gc.last == L) gc.last = NULL;
+}
+
+void lua_gc_set_mode(LuaGcMode m) {
+    mode = m;
+    if (mode != LUA_GC_BURST) restart();
+}
+
+LuaGcMode lua_gc_get_mode(void) {
+    return mode;
+}
+
+const char *lua_gc_mode_name(LuaGcMode m) {
+    switch (m) {
+    case LUA_GC_AUTO: return "auto";
+    case LUA_GC_IDLE: return "idle";
+    case LUA_GC_BURST: return "burst";
+    }
+    return "?";
+}
+
+void lua_gc_set_burst_limit(size_t bytes) {
+    burst_limit = bytes;
+    if (bytes == 0) restart();
+}
+
+size_t lua_gc_get_burst_limit(void) {
+    return burst_limit;
+}
+
+void lua_gc_get_stats(LuaGcStats *out) {
+    *out = stats;
+    if (gc.stopped) out->paused_ns += uv_hrtime() - gc.stopped_at;
+}
+
+void lua_gc_reset_stats(void) {
+    double rate = stats.rate_kb;
+    size_t heap = stats.heap_kb;
+    memset(&stats, 0, sizeof(stats));
+    stats.rate_kb = rate;       /* The schedule's, not a statistic */
+    stats.heap_kb = heap;
+    if (gc.stopped) gc.stopped_at = uv_hrtime();
+}
@@ -0,0 +1,76 @@
+/* lua_gc.h - Lua garbage collection in the editor's idle time
+ *
+ * Lua collects incrementally as it allocates, so a keymap or highlight
+ * hook that allocates can find itself paying for the garbage of others
+ * in the middle of a keystroke. The main loops hand the collector their
+ * idle time instead: when they are about to sleep, lua_gc_idle() runs
+ * LUA_GCSTEP steps for up to a budget, sized to keep up with how fast
+ * Lua allocated since the last idle period.
+ *
+ * In "burst" mode (:set luagc=burst, the default) the automatic collector
+ * is also stopped while a burst of input is handled, and started again in
+ * the next idle period, unless the heap grows by more than a limit first
+ * (:set luagcburst=SIZE). "idle" only adds the idle steps; "auto" leaves
+ * collection to Lua.
+ *
+ * One state is scheduled at a time: the one of the current buffer.
+ */
+
+#ifndef LOKI_LUA_GC_H
+#define LOKI_LUA_GC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lua.h>
+
+typedef enum {
+    LUA_GC_AUTO = 0,            /* Lua's own schedule only */
+    LUA_GC_IDLE,                /* Plus steps in idle time */
+    LUA_GC_BURST                /* Plus no automatic steps during input */
+} LuaGcMode;
+
+/* Most time an idle period gives the collector */
+#define LUA_GC_IDLE_BUDGET_NS 1000000ull
+
+/* KB a step is sized for, at least and at most */
+#define LUA_GC_STEP_MIN_KB 16
+#define LUA_GC_STEP_MAX_KB 4096
+
+/* Heap growth allowed during a burst with the collector stopped */
+#define LUA_GC_BURST_LIMIT (8u * 1024 * 1024)
+
+typedef struct LuaGcStats {
+    uint64_t idle_runs;         /* Idle periods that stepped the collector */
+    uint64_t steps;             /* LUA_GCSTEP calls */
+    uint64_t cycles;            /* Collection cycles finished by them */
+    uint64_t idle_ns;           /* Time in them, in total */
+    uint64_t max_ns;            /* The longest idle period's */
+    uint64_t bursts;            /* Bursts begun with the collector stopped */
+    uint64_t overflows;         /* Of those, restarted for the growth limit */
+    uint64_t paused_ns;         /* Time the collector was stopped, in total */
+    double rate_kb;             /* KB Lua allocates per idle period (mean) */
+    size_t heap_kb;             /* Heap at the last idle period */
+} LuaGcStats;
+
+/* Run collector steps on 'L' for up to 'budget_ns' (0: the default), if
+ * it allocated since the last call, and start a stopped collector again. */
+void lua_gc_idle(lua_State *L, uint64_t budget_ns);
+
+/* Input is being handled on 'L': in burst mode, stop the collector until
+ * the next idle period, or start it again past the growth limit. */
+void lua_gc_input(lua_State *L);
+
+/* Start the collector again if it is stopped on 'L', before it is closed. */
+void lua_gc_forget(lua_State *L);
+
+/* Process-wide settings; setting the mode starts a stopped collector. */
+void lua_gc_set_mode(LuaGcMode mode);
+LuaGcMode lua_gc_get_mode(void);
+const char *lua_gc_mode_name(LuaGcMode mode);
+void lua_gc_set_burst_limit(size_t bytes);
+size_t lua_gc_get_burst_limit(void);
+
+void lua_gc_get_stats(LuaGcStats *out);
+void lua_gc_reset_stats(void);
+
+#endif /* LOKI_LUA_GC_H */
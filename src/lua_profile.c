@@ -0,0 +1,274 @@
+/* lua_profile.c - Where Lua time goes (:profile lua)
+ *
+ * See lua_profile.h for an overview. The sampler's stacks live in an open
+ * addressed table keyed by a hash of the folded stack string; the hook
+ * builds that string from lua_getstack()/lua_getinfo(), outermost frame
+ * first, and bumps its count.
+ */
+
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <uv.h>
+
+#include "lua_profile.h"
+
+/* Slots of the stack table: a power of 2, at least twice the stacks */
+#define PROFILE_SLOTS (LUA_PROFILE_MAX_STACKS * 2)
+
+/* Bytes of a frame's name */
+#define PROFILE_FRAME_SIZE 160
+
+typedef struct {
+    char *stack;                /* Folded, NUL-terminated; NULL: free slot */
+    uint64_t hash;
+    uint64_t count;
+} ProfileStack;
+
+static const char *const entry_names[LUA_PROFILE_ENTRIES] = {
+    "keymap", "highlight", "command", "repl", "timer", "http", "worker",
+    "language", "job", "lsp", "change", "autocmd"
+};
+
+static LuaProfileEntryStats entries[LUA_PROFILE_ENTRIES];
+static int current_entry = -1;  /* Entry point the running Lua came from */
+
+static struct {
+    lua_State *L;               /* Being sampled */
+    ProfileStack *slots;
+    int nstacks;
+    uint64_t samples;
+    uint64_t other;             /* Samples of stacks past the limit */
+} prof;
+
+/* ======================== Entry points ======================== */
+
+int lua_profile_pcall(lua_State *L, LuaProfileEntry entry, int nargs, int nresults) {
+    int outer = current_entry;
+    current_entry = entry;
+    uint64_t start = uv_hrtime();
+    int rc = lua_pcall(L, nargs, nresults, 0);
+    uint64_t ns = uv_hrtime() - start;
+    current_entry = outer;
+
+    LuaProfileEntryStats *st = &entries[entry];
+    st->calls++;
+    if (rc != LUA_OK) st->errors++;
+    st->total_ns += ns;
+    if (ns > st->max_ns) st->max_ns = ns;
+    return rc;
+}
+
+const char *lua_profile_entry_name(LuaProfileEntry entry) {
+    return entry >= 0 && entry < LUA_PROFILE_ENTRIES ? entry_names[entry] : "?";
+}
+
+void lua_profile_get_entry(LuaProfileEntry entry, LuaProfileEntryStats *stats) {
+    *stats = entries[entry];
+}
+
+/* ======================== Sampler ======================== */
+
+/* A frame's name, with the separators of folded stacks replaced */
+static void frame_name(const lua_Debug *ar, char *buf, size_t size) {
+    if (strcmp(ar->what, "C") == 0)
+        snprintf(buf, size, "%s [C]", ar->name ? ar->name : "?");
+    else if (strcmp(ar->what, "main") == 0)
+        snprintf(buf, size, "main@%s", ar->short_src);
+    else
+        snprintf(buf, size, "%s@%s:%d", ar->name ? ar->name : "?", ar->short_src,
+                 ar->linedefined);
+    for (char *p = buf; *p; p++) {
+        if (*p == ';' || *p == ' ') *p = '_';
+    }
+}
+
+static void count_stack(const char *stack, size_t len) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)stack[i];
+        h *= 1099511628211ull;
+    }
+    if (!prof.slots) {
+        prof.slots = calloc(PROFILE_SLOTS, sizeof(ProfileStack));
+        if (!prof.slots) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    size_t i = (size_t)h & (PROFILE_SLOTS - 1);
+    while (prof.slots[i].stack) {
+        if (prof.slots[i].hash == h && strcmp(prof.slots[i].stack, stack) == 0) {
+            prof.slots[i].count++;
+            return;
+        }
+        i = (i + 1) & (PROFILE_SLOTS - 1);
+    }
+    if (prof.nstacks >= LUA_PROFILE_MAX_STACKS) {
+        prof.other++;
+        return;
+    }
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(copy, stack, len + 1);
+    prof.slots[i].stack = copy;
+    prof.slots[i].hash = h;
+    prof.slots[i].count = 1;
+    prof.nstacks++;
+}
+
+static void profile_hook(lua_State *L, lua_Debug *ar) {
+    (void)ar;
+    if (!prof.L) {
+        /* A coroutine made while sampling keeps the hook it was given */
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
+    static char frames[LUA_PROFILE_MAX_DEPTH][PROFILE_FRAME_SIZE];
+    static char stack[LUA_PROFILE_MAX_DEPTH * PROFILE_FRAME_SIZE + 16];
+    lua_Debug frame;
+    int depth = 0;
+    while (depth < LUA_PROFILE_MAX_DEPTH && lua_getstack(L, depth, &frame)) {
+        lua_getinfo(L, "Sn", &frame);
+        frame_name(&frame, frames[depth], PROFILE_FRAME_SIZE);
+        depth++;
+    }
+
+    size_t len = (size_t)snprintf(stack, sizeof(stack), "%s",
+                                  current_entry >= 0 ? entry_names[current_entry] : "other");
+    for (int i = depth - 1; i >= 0; i--) {
+        size_t n = strlen(frames[i]);
+        stack[len++] = ';';
+        memcpy(stack + len, frames[i], n);
+        len += n;
+    }
+    stack[len] = '\0';
+    count_stack(stack, len);
+    prof.samples++;
+}
+
+int lua_profile_start(lua_State *L, int interval) {
+    if (prof.L && prof.L != L) return -1;
+    prof.L = L;
+    lua_sethook(L, profile_hook, LUA_MASKCOUNT, interval > 0 ? interval : LUA_PROFILE_INTERVAL);
+    return 0;
+}
+
+void lua_profile_stop(void) {
+    if (!prof.L) return;
+    lua_sethook(prof.L, NULL, 0, 0);
+    prof.L = NULL;
+}
+
+void lua_profile_forget(lua_State *L) {
+    if (prof.L == L) prof.L = NULL;
+}
+
+int lua_profile_running(void) {
+    return prof.L != NULL;
+}
+
+uint64_t lua_profile_samples(void) {
+    return prof.samples;
+}
+
+void lua_profile_reset(void) {
+    if (prof.slots) {
+        for (int i = 0; i < PROFILE_SLOTS; i++) free(prof.slots[i].stack);
+        free(prof.slots);
+        prof.slots = NULL;
+    }
+    prof.nstacks = 0;
+    prof.samples = 0;
+    prof.other = 0;
+    memset(entries, 0, sizeof(entries));
+}
+
+/* ======================== Reports ======================== */
+
+static LuaProfileFunc *find_func(LuaProfileFunc **funcs, int *n, int *cap,
+                                 const char *name, size_t len) {
+    if (len >= sizeof((*funcs)->name)) len = sizeof((*funcs)->name) - 1;
+    for (int i = 0; i < *n; i++) {
+        if (strncmp((*funcs)[i].name, name, len) == 0 && (*funcs)[i].name[len] == '\0')
+            return &(*funcs)[i];
+    }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        LuaProfileFunc *grown = realloc(*funcs, sizeof(**funcs) * (size_t)*cap);
+        if (!grown) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *funcs = grown;
+    }
+    LuaProfileFunc *f = &(*funcs)[(*n)++];
+    memcpy(f->name, name, len);
+    f->name[len] = '\0';
+    f->self = f->total = 0;
+    return f;
+}
+
+static int by_self(const void *a, const void *b) {
+    const LuaProfileFunc *x = a, *y = b;
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+int lua_profile_top(LuaProfileFunc *out, int max) {
+    LuaProfileFunc *funcs = NULL;
+    int n = 0, cap = 0;
+    for (int i = 0; prof.slots && i < PROFILE_SLOTS; i++) {
+        const ProfileStack *s = &prof.slots[i];
+        if (!s->stack) continue;
+
+        /* Frames after the entry point; each counted once per stack */
+        int seen[LUA_PROFILE_MAX_DEPTH];
+        int nseen = 0;
+        const char *p = strchr(s->stack, ';');
+        while (p) {
+            const char *name = p + 1;
+            p = strchr(name, ';');
+            size_t len = p ? (size_t)(p - name) : strlen(name);
+            LuaProfileFunc *f = find_func(&funcs, &n, &cap, name, len);
+            int idx = (int)(f - funcs), dup = 0;
+            for (int k = 0; k < nseen; k++) dup |= seen[k] == idx;
+            if (!dup) {
+                f->total += s->count;
+                if (nseen < LUA_PROFILE_MAX_DEPTH) seen[nseen++] = idx;
+            }
+            if (!p) f->self += s->count;
+        }
+    }
+    qsort(funcs, (size_t)n, sizeof(*funcs), by_self);
+    int k = n < max ? n : max;
+    if (k > 0) memcpy(out, funcs, sizeof(*funcs) * (size_t)k);
+    free(funcs);
+    return k;
+}
+
+int lua_profile_write_folded(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    int written = 0;
+    for (int i = 0; prof.slots && i < PROFILE_SLOTS; i++) {
+        if (!prof.slots[i].stack) continue;
+        fprintf(f, "%s %llu\n", prof.slots[i].stack, (unsigned long long)prof.slots[i].count);
+        written++;
+    }
+    if (prof.other) {
+        fprintf(f, "[other] %llu\n", (unsigned long long)prof.other);
+        written++;
+    }
+    if (fclose(f) != 0) return -1;
+    return written;
+}
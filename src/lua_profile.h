@@ -0,0 +1,99 @@
+/* lua_profile.h - Where Lua time goes (:profile lua)
+ *
+ * Every call the editor makes into Lua from a keymap, highlight hook, ex
+ * command, the REPL, a timer, an HTTP callback, a worker result or a
+ * declared language's loader goes
+ * through lua_profile_pcall(), which counts the calls of each entry
+ * point and their wall-clock time, errors included. Time is inclusive:
+ * an entry reached from inside another is counted in both.
+ *
+ * The sampler, when started, has lua_sethook(LUA_MASKCOUNT) stop Lua
+ * every so many instructions and record the call stack it was in, under
+ * the entry point it came from: "keymap;on_key@init.lua:12;helper@...".
+ * Stacks are counted in a table and written as folded stacks, one
+ * "frame;frame;frame count" line each, as flame graph tools read them.
+ * Samples count Lua instructions, so time spent inside one C function
+ * (a long string.find, say) shows only in the entry point timings.
+ */
+
+#ifndef LOKI_LUA_PROFILE_H
+#define LOKI_LUA_PROFILE_H
+
+#include <stdint.h>
+#include <lua.h>
+
+typedef enum {
+    LUA_PROFILE_KEYMAP = 0,     /* loki.keymap() functions */
+    LUA_PROFILE_HIGHLIGHT,      /* loki.highlight_row(s) */
+    LUA_PROFILE_COMMAND,        /* Ex commands from Lua */
+    LUA_PROFILE_REPL,           /* REPL input */
+    LUA_PROFILE_TIMER,          /* loki.set_timeout(), set_interval() */
+    LUA_PROFILE_HTTP,           /* HTTP callbacks and chunks */
+    LUA_PROFILE_WORKER,         /* loki.spawn() and read_file() results */
+    LUA_PROFILE_LANGUAGE,       /* loki.declare_language() loaders */
+    LUA_PROFILE_JOB,            /* loki.job_start() output and exits */
+    LUA_PROFILE_LSP,            /* loki.lsp_complete(), lsp_hover() answers */
+    LUA_PROFILE_CHANGE,         /* loki.on_change() watches */
+    LUA_PROFILE_AUTOCMD,        /* loki.autocmd() handlers */
+    LUA_PROFILE_ENTRIES
+} LuaProfileEntry;
+
+/* Instructions between samples by default */
+#define LUA_PROFILE_INTERVAL 1000
+
+/* Frames of a stack kept, from the innermost */
+#define LUA_PROFILE_MAX_DEPTH 64
+
+/* Distinct stacks counted; samples of more go under "[other]" */
+#define LUA_PROFILE_MAX_STACKS 4096
+
+typedef struct LuaProfileEntryStats {
+    uint64_t calls;
+    uint64_t errors;            /* Calls that raised an error */
+    uint64_t total_ns;
+    uint64_t max_ns;
+} LuaProfileEntryStats;
+
+/* A function's share of the samples */
+typedef struct LuaProfileFunc {
+    char name[160];             /* The frame, as in the folded stacks */
+    uint64_t self;              /* Samples with it innermost */
+    uint64_t total;             /* Samples with it anywhere in the stack */
+} LuaProfileFunc;
+
+/* lua_pcall(L, nargs, nresults, 0), timed as a call of 'entry'. */
+int lua_profile_pcall(lua_State *L, LuaProfileEntry entry, int nargs, int nresults);
+
+/* "keymap", "highlight", ... */
+const char *lua_profile_entry_name(LuaProfileEntry entry);
+
+void lua_profile_get_entry(LuaProfileEntry entry, LuaProfileEntryStats *stats);
+
+/* Start sampling 'L' every 'interval' instructions (<= 0: the default).
+ * Returns 0, or -1 if it is sampling another state already. */
+int lua_profile_start(lua_State *L, int interval);
+
+/* Stop sampling; the samples are kept. */
+void lua_profile_stop(void);
+
+/* Stop sampling 'L' if it is, before it is closed. */
+void lua_profile_forget(lua_State *L);
+
+/* 1 while sampling */
+int lua_profile_running(void);
+
+/* Samples taken since the last reset */
+uint64_t lua_profile_samples(void);
+
+/* Clear the samples and the entry point timings. */
+void lua_profile_reset(void);
+
+/* The 'max' functions with the most self samples, most first, in 'out'.
+ * Returns how many. */
+int lua_profile_top(LuaProfileFunc *out, int max);
+
+/* Write the samples to 'path' as folded stacks. Returns the number of
+ * stacks written, or -1 (errno set). */
+int lua_profile_write_folded(const char *path);
+
+#endif /* LOKI_LUA_PROFILE_H */
@@ -0,0 +1,655 @@
+/* lua_worker.c - Lua code run off the main thread (loki.spawn())
+ *
+ * See lua_worker.h for an overview. Jobs wait in one list behind a mutex;
+ * the pool's threads are started with the first job and each takes the
+ * oldest job waiting. A job owns its source, arguments and snapshot, and
+ * the worker running it frees them. Messages and results leave a worker
+ * as LuaWorkerReply blocks in LUA_WORKER_ASYNC_EVENT events.
+ *
+ * Values are encoded as a tag byte and what follows it:
+ *
+ *   'n' nil, 'f' false, 't' true, 'i' int64, 'd' double,
+ *   's' uint32 length then the bytes, 'T' key/value pairs then 'E'
+ */
+
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L     /* nanosleep() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <uv.h>
+#include <stdatomic.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "lua_worker.h"
+#include "model_snapshot.h"
+#include "memstats.h"
+
+/* Registry key of the running job in a worker state */
+#define WORKER_JOB_KEY "loki_worker_job"
+
+typedef struct LuaJob {
+    int id;
+    lua_State *owner;
+    char *path;                 /* A file to read, not code to run */
+    char *source;
+    size_t len;
+    LuaWorkerValue args;
+    LuaWorkerSnapshot snap;
+    struct LuaJob *next;
+} LuaJob;
+
+static struct {
+    int initialized;
+    uv_mutex_t lock;
+    uv_cond_t cond;             /* A job was queued, or stop */
+    uv_thread_t threads[LUA_WORKER_MAX_THREADS];
+    int nthreads;
+    LuaJob *head, *tail;
+    int next_id;
+    atomic_int pending;
+    atomic_int stopping;
+} pool;
+
+/* ======================== Values ======================== */
+
+static void value_append(LuaWorkerValue *v, const void *p, size_t n) {
+    if (v->len + n > v->cap) {
+        size_t cap = v->cap ? v->cap : 64;
+        while (cap < v->len + n) cap *= 2;
+        char *data = realloc(v->data, cap);
+        if (!data) {
+            perror("Out of memory");
+            exit(1);
+        }
+        v->data = data;
+        v->cap = cap;
+    }
+    memcpy(v->data + v->len, p, n);
+    v->len += n;
+}
+
+static void value_tag(LuaWorkerValue *v, char tag) {
+    value_append(v, &tag, 1);
+}
+
+static void value_lstring(LuaWorkerValue *v, const char *s, size_t len) {
+    uint32_t n = (uint32_t)len;
+    value_tag(v, 's');
+    value_append(v, &n, sizeof(n));
+    value_append(v, s, len);
+}
+
+static void value_string(LuaWorkerValue *v, const char *s) {
+    value_lstring(v, s, strlen(s));
+}
+
+/* Encode the value at 'idx' (absolute). Returns NULL, or what is wrong. */
+static const char *encode_value(lua_State *L, int idx, int depth, LuaWorkerValue *out) {
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        value_tag(out, 'n');
+        return NULL;
+    case LUA_TBOOLEAN:
+        value_tag(out, lua_toboolean(L, idx) ? 't' : 'f');
+        return NULL;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            int64_t i = (int64_t)lua_tointeger(L, idx);
+            value_tag(out, 'i');
+            value_append(out, &i, sizeof(i));
+            return NULL;
+        }
+#endif
+        {
+            double d = (double)lua_tonumber(L, idx);
+            value_tag(out, 'd');
+            value_append(out, &d, sizeof(d));
+        }
+        return NULL;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *s = lua_tolstring(L, idx, &len);
+        if (len > UINT32_MAX) return "string too long to copy";
+        value_lstring(out, s, len);
+        return NULL;
+    }
+    case LUA_TTABLE:
+        if (depth >= LUA_WORKER_MAX_DEPTH) return "tables nested too deep to copy";
+        if (!lua_checkstack(L, 3)) return "tables nested too deep to copy";
+        value_tag(out, 'T');
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            int top = lua_gettop(L);
+            const char *err = encode_value(L, top - 1, depth + 1, out);
+            if (!err) err = encode_value(L, top, depth + 1, out);
+            lua_pop(L, 1);
+            if (err) {
+                lua_pop(L, 1);      /* The key */
+                return err;
+            }
+        }
+        value_tag(out, 'E');
+        return NULL;
+    default:
+        return "only nil, booleans, numbers, strings and tables can be copied";
+    }
+}
+
+int lua_worker_encode(lua_State *L, int idx, int n, LuaWorkerValue *out) {
+    if (idx < 0) idx = lua_gettop(L) + idx + 1;
+    for (int i = 0; i < n; i++) {
+        const char *err = encode_value(L, idx + i, 0, out);
+        if (err) {
+            lua_pushfstring(L, "%s (got a %s)", err, luaL_typename(L, idx + i));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Push the value at *pos, moving past it */
+static void decode_value(lua_State *L, const char *data, size_t len, size_t *pos) {
+    char tag = data[(*pos)++];
+    switch (tag) {
+    case 'f':
+    case 't':
+        lua_pushboolean(L, tag == 't');
+        break;
+    case 'i': {
+        int64_t i;
+        memcpy(&i, data + *pos, sizeof(i));
+        *pos += sizeof(i);
+        lua_pushinteger(L, (lua_Integer)i);
+        break;
+    }
+    case 'd': {
+        double d;
+        memcpy(&d, data + *pos, sizeof(d));
+        *pos += sizeof(d);
+        lua_pushnumber(L, (lua_Number)d);
+        break;
+    }
+    case 's': {
+        uint32_t n;
+        memcpy(&n, data + *pos, sizeof(n));
+        *pos += sizeof(n);
+        lua_pushlstring(L, data + *pos, n);
+        *pos += n;
+        break;
+    }
+    case 'T':
+        luaL_checkstack(L, 3, "copying a table");
+        lua_newtable(L);
+        while (*pos < len && data[*pos] != 'E') {
+            decode_value(L, data, len, pos);
+            decode_value(L, data, len, pos);
+            lua_rawset(L, -3);
+        }
+        (*pos)++;
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+int lua_worker_decode(lua_State *L, const char *data, size_t len) {
+    size_t pos = 0;
+    int n = 0;
+    while (pos < len) {
+        luaL_checkstack(L, 1, "copying values");
+        decode_value(L, data, len, &pos);
+        n++;
+    }
+    return n;
+}
+
+void lua_worker_value_free(LuaWorkerValue *v) {
+    free(v->data);
+    v->data = NULL;
+    v->len = v->cap = 0;
+}
+
+/* ======================== Snapshots ======================== */
+
+void lua_worker_snapshot_take(editor_ctx_t *ctx, LuaWorkerSnapshot *snap) {
+    snap->rows = editor_model_snapshot(ctx);
+    snap->numrows = editor_snapshot_numrows(snap->rows);
+    snap->filename = ctx->model.filename ? strdup(ctx->model.filename) : NULL;
+    if (ctx->model.filename && !snap->filename) {
+        perror("Out of memory");
+        exit(1);
+    }
+}
+
+/* Released wherever the job ends: snapshots may be let go of on any thread */
+void lua_worker_snapshot_free(LuaWorkerSnapshot *snap) {
+    free(snap->filename);
+    editor_snapshot_release(snap->rows);
+    memset(snap, 0, sizeof(*snap));
+}
+
+/* ======================== Worker API ======================== */
+
+static LuaJob *worker_job(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, WORKER_JOB_KEY);
+    LuaJob *job = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return job;
+}
+
+/* Deliver a reply to the job's owner, waiting for room in the queue.
+ * Dropped once the workers are stopping. */
+static void push_reply(LuaJob *job, int kind, const char *data, size_t len) {
+    LuaWorkerReply *reply = malloc(sizeof(*reply) + len);
+    if (!reply) {
+        perror("Out of memory");
+        exit(1);
+    }
+    reply->owner = job->owner;
+    reply->len = len;
+    if (len) memcpy(reply->data, data, len);
+
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = LUA_WORKER_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+    ev.data.user.i64[1] = kind;
+    ev.data.user.ptr = reply;
+    ev.heap_data = reply;
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&pool.stopping)) {
+            free(reply);
+            return;
+        }
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* loki.line_count() - Rows in the snapshot */
+static int worker_line_count(lua_State *L) {
+    lua_pushinteger(L, worker_job(L)->snap.numrows);
+    return 1;
+}
+
+/* loki.line(row) - Text of a row (0-based) of the snapshot, or nil */
+static int worker_line(lua_State *L) {
+    const LuaWorkerSnapshot *snap = &worker_job(L)->snap;
+    lua_Integer row = luaL_checkinteger(L, 1);
+    if (row < 0 || row >= snap->numrows) {
+        lua_pushnil(L);
+        return 1;
+    }
+    size_t len;
+    const char *text = editor_snapshot_row(snap->rows, (int)row, &len);
+    lua_pushlstring(L, text, len);
+    return 1;
+}
+
+static int worker_lines_next(lua_State *L) {
+    const LuaWorkerSnapshot *snap = &worker_job(L)->snap;
+    lua_Integer row = lua_tointeger(L, lua_upvalueindex(1));
+    lua_Integer last = lua_tointeger(L, lua_upvalueindex(2));
+    if (row > last || row >= snap->numrows) return 0;
+    lua_pushinteger(L, row + 1);
+    lua_replace(L, lua_upvalueindex(1));
+    size_t len;
+    const char *text = editor_snapshot_row(snap->rows, (int)row, &len);
+    lua_pushinteger(L, row);
+    lua_pushlstring(L, text, len);
+    return 2;
+}
+
+/* loki.lines([first [, last]]) - Iterate row, text over the snapshot */
+static int worker_lines(lua_State *L) {
+    const LuaWorkerSnapshot *snap = &worker_job(L)->snap;
+    lua_Integer first = luaL_optinteger(L, 1, 0);
+    lua_Integer last = luaL_optinteger(L, 2, snap->numrows - 1);
+    if (first < 0) first = 0;
+    lua_pushinteger(L, first);
+    lua_pushinteger(L, last);
+    lua_pushcclosure(L, worker_lines_next, 2);
+    return 1;
+}
+
+/* loki.filename() - The snapshot's file, or nil */
+static int worker_filename(lua_State *L) {
+    const LuaWorkerSnapshot *snap = &worker_job(L)->snap;
+    if (snap->filename) lua_pushstring(L, snap->filename);
+    else lua_pushnil(L);
+    return 1;
+}
+
+/* loki.post(...) - Send values to the job's on_message callback */
+static int worker_post(lua_State *L) {
+    LuaWorkerValue v = {NULL, 0, 0};
+    if (lua_worker_encode(L, 1, lua_gettop(L), &v) != 0) {
+        lua_worker_value_free(&v);
+        return lua_error(L);
+    }
+    push_reply(worker_job(L), LUA_WORKER_EVENT_MESSAGE, v.data, v.len);
+    lua_worker_value_free(&v);
+    return 0;
+}
+
+static void worker_hook(lua_State *L, lua_Debug *ar) {
+    (void)ar;
+    if (atomic_load(&pool.stopping)) luaL_error(L, "stopped");
+}
+
+static void open_lib(lua_State *L, const char *name, lua_CFunction open) {
+#if LUA_VERSION_NUM >= 502
+    luaL_requiref(L, name, open, 1);
+    lua_pop(L, 1);
+#else
+    lua_pushcfunction(L, open);
+    lua_pushstring(L, name);
+    lua_call(L, 1, 0);
+#endif
+}
+
+static lua_State *worker_state(void) {
+    lua_State *L = luaL_newstate();
+    if (!L) return NULL;
+    memstats_lua_attach(L);
+    open_lib(L, "_G", luaopen_base);
+    open_lib(L, LUA_TABLIBNAME, luaopen_table);
+    open_lib(L, LUA_STRLIBNAME, luaopen_string);
+    open_lib(L, LUA_MATHLIBNAME, luaopen_math);
+#if LUA_VERSION_NUM >= 503
+    open_lib(L, LUA_UTF8LIBNAME, luaopen_utf8);
+#endif
+    /* Nothing that reaches the file system or the terminal */
+    static const char *const unsafe[] = { "dofile", "loadfile", "print", NULL };
+    for (int i = 0; unsafe[i]; i++) {
+        lua_pushnil(L);
+        lua_setglobal(L, unsafe[i]);
+    }
+
+    static const luaL_Reg api[] = {
+        {"line", worker_line},
+        {"lines", worker_lines},
+        {"line_count", worker_line_count},
+        {"filename", worker_filename},
+        {"post", worker_post},
+        {NULL, NULL}
+    };
+    lua_newtable(L);
+    for (const luaL_Reg *r = api; r->name; r++) {
+        lua_pushcfunction(L, r->func);
+        lua_setfield(L, -2, r->name);
+    }
+    lua_setglobal(L, "loki");
+
+    lua_sethook(L, worker_hook, LUA_MASKCOUNT, LUA_WORKER_HOOK_COUNT);
+    return L;
+}
+
+/* Give the chunk on top of the stack a global table of its own, reading
+ * through to the state's */
+static void set_job_env(lua_State *L) {
+    lua_newtable(L);
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    lua_pushglobaltable(L);
+#else
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "_G");
+#if LUA_VERSION_NUM >= 502
+    const char *name;
+    for (int i = 1; (name = lua_getupvalue(L, -2, i)) != NULL; i++) {
+        lua_pop(L, 1);
+        if (strcmp(name, "_ENV") == 0) {
+            lua_setupvalue(L, -2, i);
+            return;
+        }
+    }
+    lua_pop(L, 1);      /* Uses no globals */
+#else
+    lua_setfenv(L, -2);
+#endif
+}
+
+static void run_job(lua_State *L, LuaJob *job) {
+    lua_settop(L, 0);
+    lua_pushlightuserdata(L, job);
+    lua_setfield(L, LUA_REGISTRYINDEX, WORKER_JOB_KEY);
+
+    int rc = luaL_loadbuffer(L, job->source, job->len, "=spawn");
+    if (rc == LUA_OK) {
+        set_job_env(L);
+        int nargs = lua_worker_decode(L, job->args.data, job->args.len);
+        rc = lua_pcall(L, nargs, LUA_MULTRET, 0);
+    }
+
+    LuaWorkerValue result = {NULL, 0, 0};
+    if (rc == LUA_OK && lua_worker_encode(L, 1, lua_gettop(L), &result) == 0) {
+        push_reply(job, LUA_WORKER_EVENT_DONE, result.data, result.len);
+    } else {
+        /* The error is on top: the chunk's, or the encoder's */
+        lua_worker_value_free(&result);
+        const char *err = lua_tostring(L, -1);
+        lua_settop(L, 0);
+        lua_pushstring(L, err ? err : "error object is not a string");
+        lua_worker_encode(L, 1, 1, &result);
+        push_reply(job, LUA_WORKER_EVENT_ERROR, result.data, result.len);
+    }
+    lua_worker_value_free(&result);
+
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, WORKER_JOB_KEY);
+    lua_gc(L, LUA_GCCOLLECT, 0);    /* The job's globals */
+}
+
+/* Read the job's file: its text, or the error */
+static void read_job(LuaJob *job) {
+    LuaWorkerValue v = {NULL, 0, 0};
+    FILE *f = fopen(job->path, "rb");
+    char *text = NULL;
+    size_t len = 0, cap = 0;
+    int ok = f != NULL;
+    while (ok) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 64 * 1024;
+            if (cap > UINT32_MAX) {
+                errno = EFBIG;
+                ok = 0;
+                break;
+            }
+            char *grown = realloc(text, cap);
+            if (!grown) {
+                perror("Out of memory");
+                exit(1);
+            }
+            text = grown;
+        }
+        size_t n = fread(text + len, 1, cap - len, f);
+        len += n;
+        if (n == 0) {
+            if (ferror(f)) ok = 0;
+            break;
+        }
+    }
+    int saved = errno;
+    if (f) fclose(f);
+    if (ok) {
+        value_lstring(&v, text ? text : "", len);
+        push_reply(job, LUA_WORKER_EVENT_DONE, v.data, v.len);
+    } else {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "%s: %s", job->path, strerror(saved));
+        value_string(&v, msg);
+        push_reply(job, LUA_WORKER_EVENT_ERROR, v.data, v.len);
+    }
+    free(text);
+    lua_worker_value_free(&v);
+}
+
+static void job_free(LuaJob *job) {
+    free(job->path);
+    free(job->source);
+    lua_worker_value_free(&job->args);
+    lua_worker_snapshot_free(&job->snap);
+    free(job);
+}
+
+static void worker_main(void *arg) {
+    (void)arg;
+    lua_State *L = NULL;
+    for (;;) {
+        uv_mutex_lock(&pool.lock);
+        while (!pool.head && !atomic_load(&pool.stopping))
+            uv_cond_wait(&pool.cond, &pool.lock);
+        if (atomic_load(&pool.stopping)) {
+            uv_mutex_unlock(&pool.lock);
+            break;
+        }
+        LuaJob *job = pool.head;
+        pool.head = job->next;
+        if (!pool.head) pool.tail = NULL;
+        uv_mutex_unlock(&pool.lock);
+
+        if (job->path) {
+            read_job(job);
+        } else if (!L && !(L = worker_state())) {
+            LuaWorkerValue err = {NULL, 0, 0};
+            value_string(&err, "no memory for a worker state");
+            push_reply(job, LUA_WORKER_EVENT_ERROR, err.data, err.len);
+            lua_worker_value_free(&err);
+        } else {
+            run_job(L, job);
+        }
+        job_free(job);
+        atomic_fetch_sub(&pool.pending, 1);
+    }
+    if (L) lua_close(L);
+}
+
+/* ======================== Pool ======================== */
+
+static int thread_count(void) {
+#if UV_VERSION_HEX >= ((1 << 16) | (44 << 8))
+    int n = (int)uv_available_parallelism();
+#else
+    uv_cpu_info_t *cpus;
+    int n = 1;
+    if (uv_cpu_info(&cpus, &n) == 0) uv_free_cpu_info(cpus, n);
+#endif
+    if (n < 1) n = 1;
+    if (n > LUA_WORKER_MAX_THREADS) n = LUA_WORKER_MAX_THREADS;
+    return n;
+}
+
+/* Hand a job to the pool, starting a thread if all are busy. Takes the
+ * job over either way. */
+static int queue_job(LuaJob *job, const char **error) {
+    if (!async_queue_global()) {
+        *error = "Workers need the event queue";
+        job_free(job);
+        return -1;
+    }
+    if (!pool.initialized) {
+        if (uv_mutex_init(&pool.lock) != 0 || uv_cond_init(&pool.cond) != 0) {
+            *error = "Can't start workers";
+            job_free(job);
+            return -1;
+        }
+        pool.initialized = 1;
+    }
+
+    uv_mutex_lock(&pool.lock);
+    int want = thread_count();
+    while (pool.nthreads < want &&
+           pool.nthreads <= atomic_load(&pool.pending)) {
+        if (uv_thread_create(&pool.threads[pool.nthreads], worker_main, NULL) != 0) break;
+        pool.nthreads++;
+    }
+    if (pool.nthreads == 0) {
+        uv_mutex_unlock(&pool.lock);
+        *error = "Can't start workers";
+        job_free(job);
+        return -1;
+    }
+    if (++pool.next_id <= 0) pool.next_id = 1;
+    int id = job->id = pool.next_id;
+    if (pool.tail) pool.tail->next = job;
+    else pool.head = job;
+    pool.tail = job;
+    atomic_fetch_add(&pool.pending, 1);
+    uv_cond_signal(&pool.cond);
+    uv_mutex_unlock(&pool.lock);
+    return id;
+}
+
+int lua_worker_spawn(lua_State *owner, const char *source, size_t len,
+                     LuaWorkerValue *args, LuaWorkerSnapshot *snap,
+                     const char **error) {
+    LuaWorkerValue no_args = {NULL, 0, 0};
+    LuaWorkerSnapshot no_snap;
+    memset(&no_snap, 0, sizeof(no_snap));
+    if (!args) args = &no_args;
+    if (!snap) snap = &no_snap;
+
+    LuaJob *job = calloc(1, sizeof(*job));
+    char *copy = malloc(len ? len : 1);
+    if (!job || !copy) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(copy, source, len);
+    job->owner = owner;
+    job->source = copy;
+    job->len = len;
+    job->args = *args;
+    job->snap = *snap;
+    memset(args, 0, sizeof(*args));
+    memset(snap, 0, sizeof(*snap));
+    return queue_job(job, error);
+}
+
+int lua_worker_read_file(lua_State *owner, const char *path, const char **error) {
+    LuaJob *job = calloc(1, sizeof(*job));
+    if (!job || !(job->path = strdup(path))) {
+        perror("Out of memory");
+        exit(1);
+    }
+    job->owner = owner;
+    return queue_job(job, error);
+}
+
+int lua_worker_pending(void) {
+    return atomic_load(&pool.pending);
+}
+
+void lua_worker_stop_all(void) {
+    if (!pool.initialized) return;
+    uv_mutex_lock(&pool.lock);
+    atomic_store(&pool.stopping, 1);
+    while (pool.head) {
+        LuaJob *job = pool.head;
+        pool.head = job->next;
+        job_free(job);
+        atomic_fetch_sub(&pool.pending, 1);
+    }
+    pool.tail = NULL;
+    uv_cond_broadcast(&pool.cond);
+    uv_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.nthreads; i++) uv_thread_join(&pool.threads[i]);
+    pool.nthreads = 0;
+    atomic_store(&pool.stopping, 0);
+}
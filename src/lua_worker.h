@@ -0,0 +1,101 @@
+/* lua_worker.h - Lua code run off the main thread (loki.spawn())
+ *
+ * A spawned job is a chunk of Lua run on one of a small pool of worker
+ * threads, each with a lua_State of its own made on first use and kept
+ * for the jobs after. A worker state has the base, string, table, math
+ * and utf8 libraries, without the ones that reach outside it (io, os,
+ * package, debug, print, dofile, loadfile), and each job runs with its
+ * own global table over those. Its 'loki' table reads a snapshot of a
+ * buffer's rows taken when the job was spawned, and posts messages back.
+ * The pool also reads files for loki.read_file(), without a lua_State.
+ *
+ * Nothing is shared between the states: the arguments of a job, its
+ * messages and its result are copied across as plain values (nil,
+ * booleans, numbers, strings and tables of them; see lua_worker_encode())
+ * and delivered on the main thread through the async event queue.
+ */
+
+#ifndef LOKI_LUA_WORKER_H
+#define LOKI_LUA_WORKER_H
+
+#include <stddef.h>
+#include <lua.h>
+#include "internal.h"
+#include "async_queue.h"
+
+/* Async event carrying a job's message or result (data.user.i64[0] = job
+ * id, i64[1] = LUA_WORKER_EVENT_*) */
+#define LUA_WORKER_ASYNC_EVENT (ASYNC_EVENT_USER + 5)
+
+#define LUA_WORKER_EVENT_MESSAGE 0  /* loki.post() */
+#define LUA_WORKER_EVENT_DONE 1     /* The chunk returned */
+#define LUA_WORKER_EVENT_ERROR 2    /* It raised an error (a string) */
+
+/* Worker threads at most, fewer on fewer CPUs */
+#define LUA_WORKER_MAX_THREADS 4
+
+/* Tables nest this deep at most in a copied value */
+#define LUA_WORKER_MAX_DEPTH 32
+
+/* Number of instructions between a worker's checks for lua_worker_stop_all() */
+#define LUA_WORKER_HOOK_COUNT 10000
+
+/* A value copied out of a lua_State */
+typedef struct LuaWorkerValue {
+    char *data;
+    size_t len, cap;
+} LuaWorkerValue;
+
+/* Rows of a buffer as they were when a job was spawned */
+typedef struct LuaWorkerSnapshot {
+    char *filename;     /* Or NULL */
+    int numrows;
+    struct EditorSnapshot *rows;  /* Or NULL (see model_snapshot.h) */
+} LuaWorkerSnapshot;
+
+/* What a LUA_WORKER_ASYNC_EVENT event points at (data.user.ptr): the
+ * encoded values, for the state that spawned the job. The queue frees it. */
+typedef struct LuaWorkerReply {
+    lua_State *owner;
+    size_t len;
+    char data[];
+} LuaWorkerReply;
+
+/* Append the values at 'idx' .. 'idx' + 'n' - 1 of 'L' to 'out'. Returns 0,
+ * or -1 with a message pushed on 'L' for a value that can't be copied
+ * (a function, userdata, or tables nested too deep). */
+int lua_worker_encode(lua_State *L, int idx, int n, LuaWorkerValue *out);
+
+/* Push the values 'data' holds. Returns how many. */
+int lua_worker_decode(lua_State *L, const char *data, size_t len);
+
+void lua_worker_value_free(LuaWorkerValue *v);
+
+/* Run 'source' (Lua source or bytecode) on a worker with the values
+ * 'args' as its '...', reading 'snap' (or no buffer if NULL), and deliver
+ * its messages and result to 'owner' in LUA_WORKER_ASYNC_EVENT events.
+ * Takes 'args' and 'snap' over either way. Returns the job id (> 0), or
+ * -1 with no event queue or no threads (*error set). */
+int lua_worker_spawn(lua_State *owner, const char *source, size_t len,
+                     LuaWorkerValue *args, LuaWorkerSnapshot *snap,
+                     const char **error);
+
+/* Read the file at 'path' on a worker, and deliver its text to 'owner'
+ * as a LUA_WORKER_EVENT_DONE string, or LUA_WORKER_EVENT_ERROR. Returns
+ * as lua_worker_spawn(). */
+int lua_worker_read_file(lua_State *owner, const char *path, const char **error);
+
+/* Snapshot the rows of 'ctx' into 'snap' (sharing them, not copying). */
+void lua_worker_snapshot_take(editor_ctx_t *ctx, LuaWorkerSnapshot *snap);
+
+/* Release a snapshot's rows */
+void lua_worker_snapshot_free(LuaWorkerSnapshot *snap);
+
+/* Jobs spawned and not finished yet (queued or running) */
+int lua_worker_pending(void);
+
+/* Stop the workers: jobs still queued are dropped, running ones are
+ * stopped at their next instruction check. Before async_queue_cleanup(). */
+void lua_worker_stop_all(void);
+
+#endif /* LOKI_LUA_WORKER_H */
@@ -0,0 +1,117 @@
+/* lz.c - Small LZ77 compressor for data kept but rarely read
+ *
+ * See lz.h for the format.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash4(const unsigned char *p) {
+    return (read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a count of 15 or more as its bytes past the token */
+static unsigned char *put_count(unsigned char *op, size_t n) {
+    for (n -= 15; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+/* One sequence: 'lits' literals, then a match of 'mlen' bytes 'offset'
+ * back (no match if 'mlen' is 0) */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit,
+                                   size_t lits, size_t offset, size_t mlen) {
+    size_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = (unsigned char)((lits < 15 ? lits : 15) << 4 | (m < 15 ? m : 15));
+    if (lits >= 15) op = put_count(op, lits);
+    memcpy(op, lit, lits);
+    op += lits;
+    if (mlen == 0) return op;
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    if (m >= 15) op = put_count(op, m);
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst) {
+    const unsigned char *in = src;
+    unsigned char *op = dst;
+    uint32_t table[1 << LZ_HASH_BITS];   /* Position + 1, 0 for none */
+    memset(table, 0, sizeof(table));
+
+    size_t p = 0, anchor = 0;
+    while (len >= LZ_MIN_MATCH && p <= len - LZ_MIN_MATCH) {
+        unsigned h = hash4(in + p);
+        size_t cand = table[h];
+        table[h] = (uint32_t)(p + 1);
+        if (cand == 0 || p - (cand - 1) > LZ_MAX_OFFSET ||
+            read32(in + cand - 1) != read32(in + p)) {
+            p++;
+            continue;
+        }
+        cand--;
+        size_t mlen = LZ_MIN_MATCH;
+        while (p + mlen < len && in[cand + mlen] == in[p + mlen]) mlen++;
+        op = put_sequence(op, in + anchor, p - anchor, p - cand, mlen);
+        p += mlen;
+        anchor = p;
+    }
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+    return (size_t)(op - (unsigned char *)dst);
+}
+
+/* Read a count continued past the token; returns -1 past the end */
+static int get_count(const unsigned char **ip, const unsigned char *end,
+                     size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t out_len) {
+    const unsigned char *ip = src, *end = ip + len;
+    unsigned char *out = dst;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t lits = token >> 4;
+        if (lits == 15 && get_count(&ip, end, &lits) == -1) return -1;
+        if (lits > (size_t)(end - ip) || lits > out_len - op) return -1;
+        memcpy(out + op, ip, lits);
+        ip += lits;
+        op += lits;
+        if (ip == end) return op == out_len ? 0 : -1;
+
+        if (end - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_count(&ip, end, &mlen) == -1) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > out_len - op) return -1;
+        /* Byte by byte: the match may overlap what it is writing */
+        for (size_t i = 0; i < mlen; i++, op++) out[op] = out[op - offset];
+    }
+    return -1;
+}
@@ -0,0 +1,31 @@
+/* lz.h - Small LZ77 compressor for data kept but rarely read
+ *
+ * Compresses a buffer in one call, in the sequence format of LZ4's
+ * block format: each sequence is a token byte (literal count in the high
+ * nibble, match length less 4 in the low one, 15 meaning more follows in
+ * bytes of 255 and a last smaller one), the literals, and a 2-byte
+ * little-endian offset back into the output. The last sequence has
+ * literals only. Matches are found through a small hash table of the
+ * last position each 4-byte prefix was seen at: fast and simple rather
+ * than tight, which suits the undo history's old groups (mostly repeated
+ * headers and text) without a dependency.
+ */
+
+#ifndef LOKI_LZ_H
+#define LOKI_LZ_H
+
+#include <stddef.h>
+
+/* Most bytes lz_compress() can write for 'len' bytes of input */
+size_t lz_bound(size_t len);
+
+/* Compress 'len' bytes at 'src' into 'dst', which has room for
+ * lz_bound(len) bytes. Returns the compressed size. */
+size_t lz_compress(const void *src, size_t len, void *dst);
+
+/* Decompress the 'len' bytes at 'src' into exactly 'out_len' bytes at
+ * 'dst'. Returns 0, or -1 if the input is malformed or does not
+ * decompress to that size. */
+int lz_decompress(const void *src, size_t len, void *dst, size_t out_len);
+
+#endif /* LOKI_LZ_H */
@@ -0,0 +1,121 @@
+/* macro.c - Recorded macros
+ *
+ * See macro.h for an overview.
+ */
+
+#include "macro.h"
+#include "undo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MACRO_REGISTERS 26
+
+typedef struct MacroRegister {
+    EditorEvent *events;        /* Pasted text owned by the register */
+    int count;
+    int cap;
+} MacroRegister;
+
+static MacroRegister registers[MACRO_REGISTERS];
+static int recording;           /* Register being recorded into, 0: none */
+static int playing;             /* Playbacks in progress */
+static int last_played;
+
+static MacroRegister *register_for(int reg) {
+    return reg >= 'a' && reg <= 'z' ? &registers[reg - 'a'] : NULL;
+}
+
+static void clear_register(MacroRegister *r) {
+    for (int i = 0; i < r->count; i++)
+        if (r->events[i].type == EVENT_PASTE) free((char *)r->events[i].data.paste.text);
+    free(r->events);
+    memset(r, 0, sizeof(*r));
+}
+
+int macro_start(int reg) {
+    MacroRegister *r = register_for(reg);
+    if (!r || playing) return -1;
+    clear_register(r);
+    recording = reg;
+    return 0;
+}
+
+void macro_stop(void) {
+    MacroRegister *r = register_for(recording);
+    if (r && r->count > 0) {
+        EditorEvent *last = &r->events[--r->count];
+        if (last->type == EVENT_PASTE) free((char *)last->data.paste.text);
+    }
+    recording = 0;
+}
+
+int macro_recording(void) {
+    return recording;
+}
+
+int macro_playing(void) {
+    return playing > 0;
+}
+
+void macro_record(const EditorEvent *event) {
+    MacroRegister *r = register_for(recording);
+    if (!r || playing || (event->type != EVENT_KEY && event->type != EVENT_PASTE))
+        return;
+    if (r->count == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 64;
+        EditorEvent *events = realloc(r->events, sizeof(*events) * (size_t)cap);
+        if (!events) {
+            perror("Out of memory");
+            exit(1);
+        }
+        r->events = events;
+        r->cap = cap;
+    }
+    EditorEvent copy = *event;
+    if (copy.type == EVENT_PASTE) {
+        char *text = malloc(copy.data.paste.len + 1);
+        if (!text) {
+            perror("Out of memory");
+            exit(1);
+        }
+        memcpy(text, event->data.paste.text, copy.data.paste.len);
+        text[copy.data.paste.len] = '\0';
+        copy.data.paste.text = text;
+    }
+    r->events[r->count++] = copy;
+}
+
+const EditorEvent *macro_events(int reg, int *count) {
+    MacroRegister *r = register_for(reg);
+    *count = r ? r->count : 0;
+    return r && r->count ? r->events : NULL;
+}
+
+int macro_play(editor_ctx_t *ctx, int reg, int count) {
+    if (reg == '@') reg = last_played;
+    MacroRegister *r = register_for(reg);
+    /* Not the register being recorded into, which holds this @ already */
+    if (!r || r->count == 0 || reg == recording || playing >= MACRO_MAX_DEPTH)
+        return -1;
+    last_played = reg;
+
+    const EditorEvent *events = r->events;
+    int n = r->count;
+
+    undo_break_group(ctx);
+    undo_hold_group(ctx);
+    playing++;
+    for (int i = 0; i < count; i++)
+        for (int e = 0; e < n; e++) modal_process_event(ctx, &events[e]);
+    playing--;
+    undo_release_group(ctx);
+    undo_break_group(ctx);
+    return 0;
+}
+
+void macro_clear_all(void) {
+    for (int i = 0; i < MACRO_REGISTERS; i++) clear_register(&registers[i]);
+    recording = 0;
+    last_played = 0;
+}
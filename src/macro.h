@@ -0,0 +1,54 @@
+/* macro.h - Recorded macros (q and @)
+ *
+ * In normal mode, q followed by a register a-z records the events that
+ * follow into it, until q is pressed in normal mode again; @ followed by
+ * a register plays them back, @@ the register played last, and a count
+ * before @ plays them that many times.
+ *
+ * Events are kept as the EditorEvents modal_process_event() was given,
+ * pasted text copied. Playback feeds them to modal_process_event() in a
+ * batch: all within the key that started it, so no frame is drawn and no
+ * highlighting is brought up to date until the last one, and with the
+ * undo group held, so the whole playback is one undo step (undo and redo
+ * inside a macro do nothing). What the edits damaged is drawn by the one
+ * frame after it. Events played back are not recorded again.
+ */
+
+#ifndef LOKI_MACRO_H
+#define LOKI_MACRO_H
+
+#include "internal.h"
+#include "event.h"
+
+/* Playbacks nested (a macro playing another) before @ gives up */
+#define MACRO_MAX_DEPTH 16
+
+/* Start recording into register 'reg' (a-z), emptying it. Returns 0, or
+ * -1 if 'reg' is not a register or a macro is being played back. */
+int macro_start(int reg);
+
+/* Stop recording; the last event recorded (the q stopping it) is dropped */
+void macro_stop(void);
+
+/* The register being recorded into, 0 if none */
+int macro_recording(void);
+
+/* Is a macro being played back? */
+int macro_playing(void);
+
+/* Add 'event' to the register being recorded into, unless none is or a
+ * macro is being played back. Keys and pasted text are recorded. */
+void macro_record(const EditorEvent *event);
+
+/* The events of register 'reg', or NULL with none */
+const EditorEvent *macro_events(int reg, int *count);
+
+/* Play register 'reg' back 'count' times; '@' is the register played
+ * last. Returns 0, or -1 if there is nothing to play: an empty register,
+ * the one being recorded into, or playbacks nested too deep. */
+int macro_play(editor_ctx_t *ctx, int reg, int count);
+
+/* Empty every register */
+void macro_clear_all(void);
+
+#endif /* LOKI_MACRO_H */
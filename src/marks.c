@@ -0,0 +1,265 @@
+/* marks.c - Positions that stay on their text across edits
+ *
+ * See marks.h for an overview. As in decor.c, a node's own position is
+ * current once its ancestors have been pushed; drow/dcol are offsets
+ * still to be applied to its children. Nodes also point at their parent,
+ * so a mark found by id can push the path above it and be read or cut.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "marks.h"
+
+typedef struct MarkNode {
+    struct MarkNode *left, *right, *parent;
+    uint32_t prio;
+    int row, col;
+    int drow, dcol;         /* Pending for the children */
+    int id;
+    int right_gravity;
+} MarkNode;
+
+struct MarkSet {
+    MarkNode *root;
+    MarkNode **by_id;       /* Node of id i+1, or NULL if deleted */
+    int ids;                /* Ids handed out */
+    int *free_ids;          /* Deleted ids, to reuse */
+    int nfree;
+    int count;
+    uint32_t seed;          /* xorshift state for priorities */
+};
+
+MarkSet *marks_new(void) {
+    MarkSet *set = calloc(1, sizeof(*set));
+    if (set) set->seed = 0x2545f491u;
+    return set;
+}
+
+void marks_free(MarkSet *set) {
+    if (!set) return;
+    for (int i = 0; i < set->ids; i++) free(set->by_id[i]);
+    free(set->by_id);
+    free(set->free_ids);
+    free(set);
+}
+
+int marks_count(const MarkSet *set) {
+    return set ? set->count : 0;
+}
+
+static void shift(MarkNode *n, int drow, int dcol) {
+    if (!n) return;
+    n->row += drow;
+    n->col += dcol;
+    n->drow += drow;
+    n->dcol += dcol;
+}
+
+static void push(MarkNode *n) {
+    if (n->drow || n->dcol) {
+        shift(n->left, n->drow, n->dcol);
+        shift(n->right, n->drow, n->dcol);
+        n->drow = n->dcol = 0;
+    }
+}
+
+/* Push every ancestor of 'n', making its own position current */
+static void push_path(MarkNode *n) {
+    if (n->parent) {
+        push_path(n->parent);
+        push(n->parent);
+    }
+}
+
+static void adopt(MarkNode *child, MarkNode *parent) {
+    if (child) child->parent = parent;
+}
+
+static int before(const MarkNode *n, int row, int col) {
+    return n->row < row || (n->row == row && n->col < col);
+}
+
+/* Split 't' into the nodes before (row, col) and the rest. The roots'
+ * parents are left to the caller. */
+static void split(MarkNode *t, int row, int col, MarkNode **l, MarkNode **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    push(t);
+    if (before(t, row, col)) {
+        split(t->right, row, col, &t->right, r);
+        adopt(t->right, t);
+        *l = t;
+    } else {
+        split(t->left, row, col, l, &t->left);
+        adopt(t->left, t);
+        *r = t;
+    }
+}
+
+/* Join two trees, every node of 'l' ordered before those of 'r' */
+static MarkNode *merge(MarkNode *l, MarkNode *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->prio > r->prio) {
+        push(l);
+        l->right = merge(l->right, r);
+        adopt(l->right, l);
+        return l;
+    }
+    push(r);
+    r->left = merge(l, r->left);
+    adopt(r->left, r);
+    return r;
+}
+
+static void set_root(MarkSet *set, MarkNode *root) {
+    adopt(root, NULL);
+    set->root = root;
+}
+
+static void insert(MarkSet *set, MarkNode *n) {
+    MarkNode *l, *r;
+    n->left = n->right = NULL;
+    n->drow = n->dcol = 0;
+    split(set->root, n->row, n->col, &l, &r);
+    adopt(l, NULL);
+    adopt(r, NULL);
+    set_root(set, merge(merge(l, n), r));
+}
+
+/* Take 'n' out of the tree, its position current */
+static void unlink_node(MarkSet *set, MarkNode *n) {
+    push_path(n);
+    push(n);
+    MarkNode *sub = merge(n->left, n->right);
+    MarkNode *parent = n->parent;
+    if (!parent) set->root = sub;
+    else if (parent->left == n) parent->left = sub;
+    else parent->right = sub;
+    adopt(sub, parent);
+}
+
+static MarkNode *find(MarkSet *set, int id) {
+    if (!set || id <= 0 || id > set->ids) return NULL;
+    return set->by_id[id - 1];
+}
+
+int marks_add(MarkSet *set, int row, int col, int right_gravity) {
+    if (row < 0 || col < 0) return -1;
+    MarkNode *n = malloc(sizeof(*n));
+    if (!n) return -1;
+
+    int id;
+    if (set->nfree > 0) {
+        id = set->free_ids[--set->nfree];
+    } else {
+        MarkNode **by_id = realloc(set->by_id, sizeof(*by_id) *
+                                   (size_t)(set->ids + 1));
+        int *free_ids = realloc(set->free_ids, sizeof(*free_ids) *
+                                (size_t)(set->ids + 1));
+        if (by_id) set->by_id = by_id;
+        if (free_ids) set->free_ids = free_ids;
+        if (!by_id || !free_ids) {
+            free(n);
+            return -1;
+        }
+        id = ++set->ids;
+    }
+
+    uint32_t x = set->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    set->seed = x;
+    n->prio = x;
+    n->row = row;
+    n->col = col;
+    n->id = id;
+    n->right_gravity = right_gravity != 0;
+    set->by_id[id - 1] = n;
+    insert(set, n);
+    set->count++;
+    return id;
+}
+
+int marks_get(MarkSet *set, int id, int *row, int *col) {
+    MarkNode *n = find(set, id);
+    if (!n) return -1;
+    push_path(n);
+    *row = n->row;
+    *col = n->col;
+    return 0;
+}
+
+int marks_move(MarkSet *set, int id, int row, int col) {
+    MarkNode *n = find(set, id);
+    if (!n || row < 0 || col < 0) return -1;
+    unlink_node(set, n);
+    n->row = row;
+    n->col = col;
+    insert(set, n);
+    return 0;
+}
+
+void marks_del(MarkSet *set, int id) {
+    MarkNode *n = find(set, id);
+    if (!n) return;
+    unlink_node(set, n);
+    set->by_id[id - 1] = NULL;
+    set->free_ids[set->nfree++] = id;
+    set->count--;
+    free(n);
+}
+
+/* Unlink the nodes of a subtree onto the list 'out' (through right) */
+static void collect(MarkNode *n, MarkNode **out) {
+    while (n) {
+        push(n);
+        collect(n->left, out);
+        MarkNode *right = n->right;
+        n->right = *out;
+        *out = n;
+        n = right;
+    }
+}
+
+void marks_note_edit(MarkSet *set, int start_row, int start_col,
+                     int old_end_row, int old_end_col,
+                     int new_end_row, int new_end_col) {
+    if (!set || !set->root) return;
+
+    /* a: before the edit; b: inside the replaced text (at its start, for
+     * an insert); c: after it on its last row; rest: on later rows */
+    int empty = start_row == old_end_row && start_col == old_end_col;
+    MarkNode *a, *b, *c, *rest;
+    split(set->root, start_row, start_col, &a, &rest);
+    if (empty) split(rest, start_row, start_col + 1, &b, &rest);
+    else split(rest, old_end_row, old_end_col, &b, &rest);
+    split(rest, old_end_row + 1, 0, &c, &rest);
+    adopt(a, NULL);
+    adopt(b, NULL);
+    adopt(c, NULL);
+    adopt(rest, NULL);
+
+    shift(c, new_end_row - old_end_row, new_end_col - old_end_col);
+    shift(rest, new_end_row - old_end_row, 0);
+    set_root(set, merge(merge(a, c), rest));
+
+    MarkNode *cut = NULL;
+    collect(b, &cut);
+    while (cut) {
+        MarkNode *next = cut->right;
+        if (cut->right_gravity) {
+            cut->row = new_end_row;
+            cut->col = new_end_col;
+        } else {
+            cut->row = start_row;
+            cut->col = start_col;
+        }
+        insert(set, cut);
+        cut = next;
+    }
+}
@@ -0,0 +1,52 @@
+/* marks.h - Positions that stay on their text across edits
+ *
+ * A mark is a (row, col) position, in chars, that edits move with the
+ * text: a line inserted above it moves it down, text typed before it on
+ * its row moves it right. '< and '> and the marks of loki.mark_set() are
+ * marks; a plain int would point at other text after the first edit
+ * above it, and fixing every position up per edit would be O(marks).
+ *
+ * The set is a treap ordered by position, with offsets applied to whole
+ * subtrees lazily on the way down (as in decor.c), so an edit costs
+ * O(log n) plus the marks inside the replaced text. Marks are named by
+ * an id, which finds the node directly; reading one is O(log n).
+ *
+ * A mark inside replaced text goes to the start of the new text, or its
+ * end with right gravity. Text inserted right at a mark goes after it,
+ * or before it with right gravity (the cursor's behaviour).
+ */
+
+#ifndef LOKI_MARKS_H
+#define LOKI_MARKS_H
+
+typedef struct MarkSet MarkSet;
+
+/* Create an empty set. Returns NULL on out of memory. */
+MarkSet *marks_new(void);
+
+/* Release a set and its marks. Safe on NULL. */
+void marks_free(MarkSet *set);
+
+/* Add a mark at (row, col). Returns its id (> 0), or -1 on out of memory
+ * or a negative position. Ids of deleted marks are reused. */
+int marks_add(MarkSet *set, int row, int col, int right_gravity);
+
+/* Current position of mark 'id'. Returns 0, or -1 if there is none. */
+int marks_get(MarkSet *set, int id, int *row, int *col);
+
+/* Put mark 'id' at (row, col). Returns 0, or -1 if there is none. */
+int marks_move(MarkSet *set, int id, int row, int col);
+
+/* Delete mark 'id', if there is one. */
+void marks_del(MarkSet *set, int id);
+
+/* Marks in the set. */
+int marks_count(const MarkSet *set);
+
+/* The text from (start_row, start_col) up to (old_end_row, old_end_col)
+ * was replaced by text ending at (new_end_row, new_end_col). */
+void marks_note_edit(MarkSet *set, int start_row, int start_col,
+                     int old_end_row, int old_end_col,
+                     int new_end_row, int new_end_col);
+
+#endif /* LOKI_MARKS_H */
@@ -0,0 +1,175 @@
+/* memstats.c - Memory accounting by subsystem
+ *
+ * See memstats.h for an overview.
+ */
+
+#define _GNU_SOURCE
+
+#include "memstats.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tree_sitter/api.h>
+#include <lua.h>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define block_size(p) malloc_size(p)
+#elif defined(__GLIBC__) || defined(__linux__)
+#include <malloc.h>
+#define block_size(p) malloc_usable_size(p)
+#else
+#define block_size(p) ((size_t)0)
+#endif
+
+typedef struct {
+    atomic_llong bytes;
+    atomic_llong peak_bytes;
+    atomic_ullong allocs;
+    atomic_ullong frees;
+} MemCounters;
+
+static MemCounters counters[MEM_TAGS];
+static int enabled = 0;
+
+static const char *tag_names[MEM_TAGS] = {
+    "core", "undo", "syntax", "treesitter", "lua", "http"
+};
+
+/* Add 'delta' to the live bytes, keeping the peak */
+static void add_bytes(MemTag tag, long long delta) {
+    MemCounters *c = &counters[tag];
+    long long now = atomic_fetch_add_explicit(&c->bytes, delta,
+                                              memory_order_relaxed) + delta;
+    long long peak = atomic_load_explicit(&c->peak_bytes, memory_order_relaxed);
+    while (now > peak &&
+           !atomic_compare_exchange_weak_explicit(&c->peak_bytes, &peak, now,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {}
+}
+
+static void note_alloc(MemTag tag, size_t bytes) {
+    add_bytes(tag, (long long)bytes);
+    atomic_fetch_add_explicit(&counters[tag].allocs, 1, memory_order_relaxed);
+}
+
+static void note_free(MemTag tag, size_t bytes) {
+    MemCounters *c = &counters[tag];
+    atomic_fetch_sub_explicit(&c->bytes, (long long)bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+}
+
+/* Tree-sitter's allocator */
+static void *ts_malloc(size_t size) {
+    return mem_malloc(MEM_TAG_TREESITTER, size);
+}
+
+static void *ts_calloc(size_t n, size_t size) {
+    return mem_calloc(MEM_TAG_TREESITTER, n, size);
+}
+
+static void *ts_realloc(void *p, size_t size) {
+    return mem_realloc(MEM_TAG_TREESITTER, p, size);
+}
+
+static void ts_free(void *p) {
+    mem_free(MEM_TAG_TREESITTER, p);
+}
+
+void memstats_enable(void) {
+    if (enabled) return;
+    enabled = 1;
+    ts_set_allocator(ts_malloc, ts_calloc, ts_realloc, ts_free);
+}
+
+void memstats_start_from_env(void) {
+    const char *v = getenv(MEMSTATS_ENV);
+    if (v && *v && strcmp(v, "0") != 0) memstats_enable();
+}
+
+int memstats_enabled(void) {
+    return enabled;
+}
+
+const char *memstats_tag_name(MemTag tag) {
+    return (unsigned)tag < MEM_TAGS ? tag_names[tag] : NULL;
+}
+
+void memstats_get(MemTag tag, MemTagStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if ((unsigned)tag >= MEM_TAGS) return;
+    MemCounters *c = &counters[tag];
+    stats->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+    stats->peak_bytes = atomic_load_explicit(&c->peak_bytes, memory_order_relaxed);
+    stats->allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+    stats->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+}
+
+void *mem_malloc(MemTag tag, size_t size) {
+    void *p = malloc(size);
+    if (enabled && p) note_alloc(tag, block_size(p));
+    return p;
+}
+
+void *mem_calloc(MemTag tag, size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (enabled && p) note_alloc(tag, block_size(p));
+    return p;
+}
+
+void *mem_realloc(MemTag tag, void *p, size_t size) {
+    if (!enabled) return realloc(p, size);
+    size_t old = p ? block_size(p) : 0;
+    void *q = realloc(p, size);
+    if (q == NULL) return NULL;         /* 'p' is untouched */
+    if (q != p) {
+        if (p) note_free(tag, old);
+        note_alloc(tag, block_size(q));
+    } else {
+        /* Grown or shrunk in place: a change of size, not a new block */
+        add_bytes(tag, (long long)block_size(q) - (long long)old);
+    }
+    return q;
+}
+
+void mem_free(MemTag tag, void *p) {
+    if (enabled && p) note_free(tag, block_size(p));
+    free(p);
+}
+
+void mem_adopt(MemTag tag, void *p) {
+    if (enabled && p) note_alloc(tag, block_size(p));
+}
+
+void memstats_note_alloc(MemTag tag, size_t bytes) {
+    if (enabled) note_alloc(tag, bytes);
+}
+
+void memstats_note_free(MemTag tag, size_t bytes) {
+    if (enabled) note_free(tag, bytes);
+}
+
+/* Lua's allocator: the sizes are Lua's, so the counts are exact */
+static void *lua_alloc(void *ud, void *p, size_t osize, size_t nsize) {
+    (void)ud;
+    if (nsize == 0) {
+        if (p) note_free(MEM_TAG_LUA, osize);
+        free(p);
+        return NULL;
+    }
+    void *q = realloc(p, nsize);
+    if (q == NULL) return NULL;
+    if (p == NULL) note_alloc(MEM_TAG_LUA, nsize);    /* 'osize' is a type */
+    else add_bytes(MEM_TAG_LUA, (long long)nsize - (long long)osize);
+    return q;
+}
+
+void memstats_lua_attach(lua_State *L) {
+    if (!enabled || !L) return;
+    /* Blocks of the default allocator are malloc()'s too, so they can be
+     * freed by this one: count what the state holds as one of them */
+    size_t held = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+                  (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+    note_alloc(MEM_TAG_LUA, held);
+    lua_setallocf(L, lua_alloc, NULL);
+}
@@ -0,0 +1,84 @@
+/* memstats.h - Memory accounting by subsystem (LOKI_MEMSTATS=1)
+ *
+ * With LOKI_MEMSTATS set when the editor starts, the heap blocks of each
+ * subsystem are counted under its tag: live bytes, their peak, and the
+ * allocations and frees made. The subsystems allocate through the thin
+ * wrappers below, or report blocks they size themselves with
+ * memstats_note_alloc() and memstats_note_free():
+ *
+ *   - core: row storage (the model's arena) and the row arrays
+ *   - undo: the undo history's arena and tables
+ *   - syntax: keyword tables and packed highlight runs
+ *   - treesitter: everything the tree-sitter library allocates
+ *   - lua: the Lua states (through their allocator)
+ *   - http: libcurl, response bodies and the response cache
+ *
+ * Bytes are those of the blocks, as the allocator reports them
+ * (malloc_usable_size()), so they include its rounding; where that isn't
+ * known, only counts are kept. Off, each wrapper is its libc call after a
+ * test of one integer. The figures are read with loki.memstats() and
+ * :stats mem.
+ */
+
+#ifndef LOKI_MEMSTATS_H
+#define LOKI_MEMSTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Environment variable turning accounting on at startup */
+#define MEMSTATS_ENV "LOKI_MEMSTATS"
+
+typedef enum {
+    MEM_TAG_CORE,
+    MEM_TAG_UNDO,
+    MEM_TAG_SYNTAX,
+    MEM_TAG_TREESITTER,
+    MEM_TAG_LUA,
+    MEM_TAG_HTTP,
+    MEM_TAGS
+} MemTag;
+
+typedef struct {
+    int64_t bytes;          /* Live */
+    int64_t peak_bytes;
+    uint64_t allocs;        /* Blocks allocated (a moving realloc() counts) */
+    uint64_t frees;
+} MemTagStats;
+
+/* Count from now on. Accounting is exact for what is allocated after
+ * this; a block from before freed through a wrapper is subtracted all
+ * the same, so turn it on before the subsystems start. */
+void memstats_enable(void);
+
+/* memstats_enable() if LOKI_MEMSTATS is set to anything but 0 */
+void memstats_start_from_env(void);
+
+/* Is accounting on? */
+int memstats_enabled(void);
+
+/* The tag's name ("core", "undo", ...), or NULL */
+const char *memstats_tag_name(MemTag tag);
+
+/* The counters of 'tag' (all zero when accounting is off) */
+void memstats_get(MemTag tag, MemTagStats *stats);
+
+/* Allocation wrappers: malloc() and friends, counted under 'tag' */
+void *mem_malloc(MemTag tag, size_t size);
+void *mem_calloc(MemTag tag, size_t n, size_t size);
+void *mem_realloc(MemTag tag, void *p, size_t size);
+void mem_free(MemTag tag, void *p);
+
+/* Count 'p', allocated elsewhere with malloc(), as the tag's from now on */
+void mem_adopt(MemTag tag, void *p);
+
+/* A block of 'bytes' sized by the caller (arena chunks, Lua's allocator) */
+void memstats_note_alloc(MemTag tag, size_t bytes);
+void memstats_note_free(MemTag tag, size_t bytes);
+
+/* Count the memory of Lua state 'L' under MEM_TAG_LUA from now on,
+ * what it holds already included, if accounting is on */
+struct lua_State;
+void memstats_lua_attach(struct lua_State *L);
+
+#endif /* LOKI_MEMSTATS_H */
@@ -15,32 +15,56 @@
  *   a - Enter INSERT mode after cursor
  *   o/O - Insert line below/above and enter INSERT mode
  *   v - Enter VISUAL mode (selection)
+ *   Ctrl-V - Enter VISUAL mode with a block (rectangular) selection
  *   x - Delete character
+ *   dd, dj, dk - Delete the line, or it and the one below/above
  *   {/} - Paragraph motion (move to prev/next empty line)
+ *   A count before a motion or operator (10j, 3x, 500dd, d4j) repeats it;
+ *   the target is worked out directly and an edit is made once
+ *   q{a-z} ... q - Record a macro; @{a-z} plays it back, @@ the last one
  *
  * INSERT mode:
  *   ESC - Return to NORMAL mode
  *   Normal typing inserts characters
  *   Arrow keys move cursor
+ *   With several cursors (block I/A): typing, backspace and left/right
+ *   act at all of them; other motions keep only the main one
  *
  * VISUAL mode:
  *   h/j/k/l - Extend selection
  *   y - Yank (copy) selection
+ *   I/A - In a block, insert before/append after it on every row
+ *   +/- - Grow to the syntax node around the selection, or shrink back
  *   ESC - Return to NORMAL mode
  */
 
 #include "modal.h"
 #include "internal.h"
 #include "selection.h"
+#include "multicursor.h"
 #include "search.h"
 #include "command.h"
 #include "terminal.h"
 #include "undo.h"
 #include "buffers.h"
 #include "lang_bridge.h"
+#include "lua_profile.h"
+#include "save.h"
+#include "trace.h"
+#include "marks.h"
+#include "fold.h"
+#include "lazy.h"
+#include "macro.h"
+#include "ghost.h"
+#include "autocmd.h"
+#include "word_index.h"
+#ifdef LOKI_USE_LINENOISE
+#include "treesitter.h"
+#endif
 #ifdef BUILD_CSOUND_BACKEND
 #include "shared/audio/audio.h"  /* For CSD file playback */
 #endif
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -48,14 +72,12 @@
 #include "lua.h"
 #include "lauxlib.h"
 
-/* Control key definition (if not already defined) */
-#ifndef CTRL_R
-#define CTRL_R 18
-#endif
-
 /* Number of times CTRL-Q must be pressed before actually quitting */
 #define KILO_QUIT_TIMES 3
 
+/* Largest count a number typed in normal mode gives */
+#define MODAL_COUNT_MAX 100000000
+
 /* Helper: check if a filename has .csd extension */
 static int is_csd_file(const char *filename) {
     if (!filename) return 0;
@@ -73,43 +95,24 @@ static int is_joy_file(const char *filename) {
 }
 
 /* Try to dispatch a keypress to a Lua keymap callback.
- * Checks _loki_keymaps.{mode}[keycode] for a registered function.
+ * Looks up the mode's callback for the key code in the host's keymaps;
+ * unmapped keys don't touch Lua at all.
  * Returns 1 if handled by Lua, 0 if not (fall through to built-in). */
-static int try_lua_keymap(editor_ctx_t *ctx, const char *mode, int key) {
-    lua_State *L = ctx_L(ctx);
-    if (!L) return 0;
-
-    /* Get _loki_keymaps global table */
-    lua_getglobal(L, "_loki_keymaps");
-    if (!lua_istable(L, -1)) {
-        lua_pop(L, 1);
-        return 0;
-    }
-
-    /* Get mode subtable (e.g., _loki_keymaps.normal) */
-    lua_getfield(L, -1, mode);
-    if (!lua_istable(L, -1)) {
-        lua_pop(L, 2);
-        return 0;
-    }
-
-    /* Get callback function at mode_table[keycode] */
-    lua_pushinteger(L, key);
-    lua_gettable(L, -2);
-    if (!lua_isfunction(L, -1)) {
-        lua_pop(L, 3);  /* Pop nil/value, mode_table, _loki_keymaps */
-        return 0;
-    }
+static int try_lua_keymap(editor_ctx_t *ctx, int mode, int key) {
+    LuaHost *host = ctx->lua_host;
+    if (!host || !host->L || !host->keymaps) return 0;
+    if (key < 0 || key >= LUA_KEYMAP_KEYS) return 0;
+    int ref = host->keymaps->refs[mode][key];
+    if (ref == LUA_NOREF) return 0;
 
     /* Found a Lua keymap - call it */
-    int pcall_result = lua_pcall(L, 0, 0, 0);
-    if (pcall_result != LUA_OK) {
+    lua_State *L = host->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    if (lua_profile_pcall(L, LUA_PROFILE_KEYMAP, 0, 0) != LUA_OK) {
         const char *err = lua_tostring(L, -1);
         editor_set_status_msg(ctx, "Lua error: %s", err ? err : "(no message)");
         lua_pop(L, 1);  /* Pop error message */
     }
-
-    lua_pop(L, 2);  /* Pop mode_table and _loki_keymaps */
     return 1;  /* Handled by Lua */
 }
 
@@ -194,6 +197,72 @@ static void move_to_prev_empty_line(editor_ctx_t *ctx) {
     ctx->view.coloff = 0;
 }
 
+/* Delete rows 'first' to 'last' (clamped to the buffer) as one edit and
+ * one undo step, like vim's dd: the cursor goes to the start of the row
+ * after them, or of the new last row. */
+static void delete_rows(editor_ctx_t *ctx, int first, int last) {
+    int numrows = ctx->model.numrows;
+    if (first < 0) first = 0;
+    if (last >= numrows) last = numrows - 1;
+    if (first > last || editor_refuse_edit(ctx)) return;
+
+    if (last < numrows - 1) {
+        editor_delete_range(ctx, first, 0, last + 1, 0, NULL, NULL);
+    } else if (first > 0) {
+        /* Through the last row: the line break before them goes instead */
+        editor_delete_range(ctx, first - 1, ctx->model.row[first - 1].size,
+                            last, INT_MAX, NULL, NULL);
+        first--;
+    } else {
+        editor_delete_range(ctx, 0, 0, last, INT_MAX, NULL, NULL);
+    }
+    editor_cursor_to(ctx, first, 0);
+    editor_view_fix(ctx);
+}
+
+/* x pressed 'count' times: delete the 'count' bytes before the cursor (a
+ * line break counts as one) in one edit */
+static void delete_chars_before(editor_ctx_t *ctx, int count) {
+    if (count <= 1) {
+        editor_del_char(ctx);
+        return;
+    }
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    if (row >= ctx->model.numrows) return;
+
+    int end_row = row, end_col = col;
+    while (count > 0 && (col > 0 || row > 0)) {
+        if (col >= count) {
+            col -= count;
+            break;
+        }
+        if (row == 0) {
+            col = 0;
+            break;
+        }
+        count -= col + 1;
+        row--;
+        col = ctx->model.row[row].size;
+    }
+    if (row == end_row && col == end_col) return;
+    editor_delete_range(ctx, row, col, end_row, end_col, &row, &col);
+    editor_cursor_to(ctx, row, col);
+    editor_view_fix(ctx);
+}
+
+/* The key after d, with 'count' the counts before and after it multiplied */
+static void process_delete(editor_ctx_t *ctx, int c, int count) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    switch (c) {
+        case 'd': delete_rows(ctx, row, row + count - 1); break;
+        case 'j': case ARROW_DOWN: delete_rows(ctx, row, row + count); break;
+        case 'k': case ARROW_UP: delete_rows(ctx, row - count, row); break;
+        case ESC: break;
+        default: editor_set_status_msg(ctx, "Unknown motion after d"); break;
+    }
+}
+
 /* Check if a line is an Alda part declaration (e.g., "piano:", "trumpet/trombone:")
  * Returns 1 if the line contains a part declaration, 0 otherwise.
  * Pattern: optional whitespace, then identifier chars, then ':' not inside quotes */
@@ -285,25 +354,106 @@ static char *get_current_part(editor_ctx_t *ctx) {
     return result;
 }
 
+/* g Ctrl-G: where the cursor is, and the size of the buffer. The counts
+ * are kept as rows change, so this costs nothing on a large buffer. */
+static void show_counts(editor_ctx_t *ctx) {
+    EditorCounts n = editor_model_counts(&ctx->model);
+    editor_set_status_msg(ctx, "Line %d of %d; Col %d; %lld words; %lld bytes%s",
+                          n.lines ? ctx->view.rowoff + ctx->view.cy + 1 : 0, n.lines,
+                          ctx->view.coloff + ctx->view.cx + 1, n.words, n.bytes,
+                          ctx->model.lazy ? " (of the rows loaded)" : "");
+}
+
 /* Process normal mode keypresses */
 static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
-    /* Check Lua keymaps first */
-    if (try_lua_keymap(ctx, "normal", c)) {
+    /* Check Lua keymaps first, but for the key a pending d, q or @ waits
+     * for */
+    int pending = ctx->view.pending_prefix;
+    if (pending != 'd' && pending != 'q' && pending != '@' && pending != 'g' &&
+        try_lua_keymap(ctx, LUA_KEYMAP_NORMAL, c)) {
+        ctx->view.count = 0;
         return;  /* Handled by Lua callback */
     }
 
+    /* A count: digits, though not a leading 0 */
+    if (pending != 'q' && pending != 'g' &&
+        ((c >= '1' && c <= '9') || (c == '0' && ctx->view.count > 0))) {
+        int count = ctx->view.count * 10 + (c - '0');
+        ctx->view.count = count < MODAL_COUNT_MAX ? count : MODAL_COUNT_MAX;
+        return;
+    }
+    int count = ctx->view.count > 0 ? ctx->view.count : 1;
+    ctx->view.count = 0;
+
+    if (pending == 'd' || pending == '@') {
+        ctx->view.pending_prefix = 0;
+        long total = (long)ctx->view.op_count * count;
+        count = total < MODAL_COUNT_MAX ? (int)total : MODAL_COUNT_MAX;
+        if (pending == 'd') {
+            process_delete(ctx, c, count);
+        } else if (c != ESC && macro_play(ctx, c, count) != 0) {
+            editor_set_status_msg(ctx, "Nothing to play in @%c", c >= 32 && c < 127 ? c : '?');
+        }
+        return;
+    }
+    if (pending == 'g') {
+        ctx->view.pending_prefix = 0;
+        if (c == CTRL_G) show_counts(ctx);
+        return;
+    }
+    if (pending == 'q') {
+        ctx->view.pending_prefix = 0;
+        if (c == ESC) return;
+        if (macro_start(c) == 0)
+            editor_set_status_msg(ctx, "recording @%c", c);
+        else
+            editor_set_status_msg(ctx, "Not a register: use a-z");
+        return;
+    }
+
     switch(c) {
-        case 'h': editor_move_cursor(ctx, ARROW_LEFT); break;
-        case 'j': editor_move_cursor(ctx, ARROW_DOWN); break;
-        case 'k': editor_move_cursor(ctx, ARROW_UP); break;
-        case 'l': editor_move_cursor(ctx, ARROW_RIGHT); break;
+        case 'h': editor_move_cursor_count(ctx, ARROW_LEFT, count); break;
+        case 'j': editor_move_cursor_count(ctx, ARROW_DOWN, count); break;
+        case 'k': editor_move_cursor_count(ctx, ARROW_UP, count); break;
+        case 'l': editor_move_cursor_count(ctx, ARROW_RIGHT, count); break;
+
+        /* Delete operator, and macro playback: the next key says what */
+        case 'd':
+        case '@':
+            ctx->view.pending_prefix = c;
+            ctx->view.op_count = count;
+            break;
+
+        /* Macro recording: the next key is the register, q again stops */
+        case 'q':
+            if (macro_recording()) {
+                int reg = macro_recording();
+                macro_stop();
+                editor_set_status_msg(ctx, "Recorded @%c", reg);
+            } else {
+                ctx->view.pending_prefix = 'q';
+            }
+            break;
+
+        /* Fold commands: the next key says which */
+        case 'z':
+            ctx->view.pending_prefix = 'z';
+            break;
+
+        /* g Ctrl-G: the counts of the buffer */
+        case 'g':
+            ctx->view.pending_prefix = 'g';
+            break;
 
         /* Paragraph motion */
         case '{':
-            move_to_prev_empty_line(ctx);
+            for (int i = 0; i < count && ctx->view.rowoff + ctx->view.cy > 0; i++)
+                move_to_prev_empty_line(ctx);
             break;
         case '}':
-            move_to_next_empty_line(ctx);
+            for (int i = 0; i < count &&
+                 ctx->view.rowoff + ctx->view.cy < ctx->model.numrows - 1; i++)
+                move_to_next_empty_line(ctx);
             break;
 
         /* Enter insert mode */
@@ -335,10 +485,12 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
             ctx->view.mode = MODE_INSERT;
             break;
 
-        /* Enter visual mode */
+        /* Enter visual mode, of text or of a block */
         case 'v':
+        case CTRL_V:
             ctx->view.mode = MODE_VISUAL;
             ctx->view.sel_active = 1;
+            ctx->view.sel_block = c == CTRL_V;
             /* Store selection in file coordinates (not screen coordinates) */
             ctx->view.sel_start_x = ctx->view.coloff + ctx->view.cx;
             ctx->view.sel_start_y = ctx->view.rowoff + ctx->view.cy;
@@ -353,27 +505,31 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
 
         /* Delete character */
         case 'x':
-            editor_del_char(ctx);
+            delete_chars_before(ctx, count);
             break;
 
         /* Undo/Redo */
-        case 'u':
-            if (undo_perform(ctx)) {
+        case 'u': {
+            int moved = undo_perform(ctx);
+            if (moved > 0) {
                 editor_set_status_msg(ctx, "Undo");
-            } else {
+            } else if (moved == 0) {
                 editor_set_status_msg(ctx, "Already at oldest change");
             }
             break;
-        case CTRL_R:
-            if (redo_perform(ctx)) {
+        }
+        case CTRL_R: {
+            int moved = redo_perform(ctx);
+            if (moved > 0) {
                 editor_set_status_msg(ctx, "Redo");
-            } else {
+            } else if (moved == 0) {
                 editor_set_status_msg(ctx, "Already at newest change");
             }
             break;
+        }
 
         /* Global commands (work in all modes) */
-        case CTRL_S: editor_save(ctx); break;
+        case CTRL_S: editor_save_async(ctx); break;
         case CTRL_F:
             /* Find requires terminal I/O - handled by modal_process_keypress().
              * From non-terminal sources (modal_process_event), this is a no-op. */
@@ -411,7 +567,7 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
                 }
 
                 /* Evaluate code with the appropriate language */
-                const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
+                const LokiLangOps *lang = loki_lang_for_buffer(ctx);
                 if (lang) {
                     int ret = loki_lang_eval(ctx, code);
                     if (ret == 0) {
@@ -482,7 +638,7 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
                 *p = '\0';
 
                 /* Evaluate full file with the appropriate language */
-                const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
+                const LokiLangOps *lang = loki_lang_for_buffer(ctx);
                 if (lang) {
                     int ret = loki_lang_eval(ctx, code);
                     if (ret == 0) {
@@ -525,7 +681,7 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
         case ARROW_DOWN:
         case ARROW_LEFT:
         case ARROW_RIGHT:
-            editor_move_cursor(ctx, c);
+            editor_move_cursor_count(ctx, c, count);
             break;
 
         default:
@@ -535,12 +691,53 @@ static void process_normal_mode(editor_ctx_t *ctx, int fd, int c) {
     }
 }
 
+/* Keys that act at every cursor while the view has extra ones (see
+ * multicursor.h). Returns 1 if 'c' was handled. Other keys leave only the
+ * view's own cursor, except control keys (saving, playing), which leave
+ * them all. */
+static int process_multicursor_key(editor_ctx_t *ctx, int c) {
+    switch (c) {
+        case BACKSPACE:
+        case CTRL_H:
+        case DEL_KEY:
+            multicursor_backspace(ctx);
+            return 1;
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            multicursor_move(ctx, c == ARROW_LEFT ? -1 : 1);
+            return 1;
+        case ENTER:
+        case ESC:
+            break;
+        default:
+            if (c == TAB || (c >= 32 && c < 256)) {
+                char ch = (char)c;
+                multicursor_insert(ctx, &ch, 1);
+                return 1;
+            }
+            if (c < 32) return 0;
+            break;
+    }
+    multicursor_clear(ctx);
+    return 0;
+}
+
 /* Process insert mode keypresses */
 static void process_insert_mode(editor_ctx_t *ctx, int fd, int c) {
+    /* A suggestion shown: TAB takes it, any other key drops it */
+    if (ctx->model.ghost) {
+        if (c == TAB && ghost_accept(ctx)) return;
+        ghost_clear(ctx);
+    }
+
+    /* Ctrl-N again takes the next match; any other key ends it */
+    if (c != CTRL_N) word_complete_end();
+
     /* Check Lua keymaps first */
-    if (try_lua_keymap(ctx, "insert", c)) {
+    if (try_lua_keymap(ctx, LUA_KEYMAP_INSERT, c)) {
         return;  /* Handled by Lua callback */
     }
+    if (multicursor_count(ctx) > 0 && process_multicursor_key(ctx, c)) return;
 
     switch(c) {
         case ESC:
@@ -561,6 +758,10 @@ static void process_insert_mode(editor_ctx_t *ctx, int fd, int c) {
             editor_del_char(ctx);
             break;
 
+        case CTRL_N:
+            word_complete_next(ctx);
+            break;
+
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -569,7 +770,7 @@ static void process_insert_mode(editor_ctx_t *ctx, int fd, int c) {
             break;
 
         /* Global commands */
-        case CTRL_S: editor_save(ctx); break;
+        case CTRL_S: editor_save_async(ctx); break;
         case CTRL_F:
             /* Find requires terminal I/O - handled by modal_process_keypress().
              * From non-terminal sources (modal_process_event), this is a no-op. */
@@ -662,7 +863,7 @@ static void process_insert_mode(editor_ctx_t *ctx, int fd, int c) {
 
                 if (code && *code) {
                     /* Evaluate code with the appropriate language */
-                    const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
+                    const LokiLangOps *lang = loki_lang_for_buffer(ctx);
                     if (lang) {
                         int ret = loki_lang_eval(ctx, code);
                         if (ret == 0) {
@@ -743,9 +944,51 @@ static void process_insert_mode(editor_ctx_t *ctx, int fd, int c) {
 }
 
 /* Process visual mode keypresses */
+/* Visual '+' and '-': grow the selection to the syntax node holding more
+ * than it, or shrink it to the node inside it holding where growing
+ * started. Only the nodes around the selection are looked at. */
+static void select_syntax_node(editor_ctx_t *ctx, int grow) {
+#ifdef LOKI_USE_LINENOISE
+    TreeSitterState *ts = ctx->model.ts_state;
+    if (ts && ts->tree && !ctx->view.sel_block) {
+        TsRange r = { ctx->view.sel_start_y, ctx->view.sel_start_x,
+                      ctx->view.sel_end_y, ctx->view.sel_end_x };
+        if (r.start_row > r.end_row ||
+            (r.start_row == r.end_row && r.start_col > r.end_col)) {
+            r = (TsRange){ r.end_row, r.end_col, r.start_row, r.start_col };
+        }
+        if (!ctx->view.sel_grown) {
+            ctx->view.sel_origin_x = ctx->view.sel_end_x;
+            ctx->view.sel_origin_y = ctx->view.sel_end_y;
+        }
+        int ok = grow ? treesitter_grow_node(ts, &r)
+                      : treesitter_shrink_node(ts, &r, ctx->view.sel_origin_y,
+                                               ctx->view.sel_origin_x);
+        if (!ok) {
+            editor_set_status_msg(ctx, grow ? "No larger syntax node"
+                                            : "No smaller syntax node");
+            return;
+        }
+        if (r.end_row >= ctx->model.numrows) {
+            r.end_row = ctx->model.numrows - 1;
+            r.end_col = ctx->model.row[r.end_row].size;
+        }
+        ctx->view.sel_start_x = r.start_col;
+        ctx->view.sel_start_y = r.start_row;
+        ctx->view.sel_end_x = r.end_col;
+        ctx->view.sel_end_y = r.end_row;
+        ctx->view.sel_grown = 1;
+        editor_cursor_to(ctx, r.end_row, r.end_col);
+        return;
+    }
+#endif
+    (void)grow;
+    editor_set_status_msg(ctx, "No syntax tree to select by");
+}
+
 static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
     /* Check Lua keymaps first */
-    if (try_lua_keymap(ctx, "visual", c)) {
+    if (try_lua_keymap(ctx, LUA_KEYMAP_VISUAL, c)) {
         return;  /* Handled by Lua callback */
     }
 
@@ -788,6 +1031,20 @@ static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
             ctx->view.sel_end_y = ctx->view.rowoff + ctx->view.cy;
             break;
 
+        /* Insert before, or append after, a block on each of its rows */
+        case 'I':
+        case 'A':
+            if (!ctx->view.sel_block) {
+                editor_set_status_msg(ctx, "Unknown visual command");
+                break;
+            }
+            {
+                int made = multicursor_from_block(ctx, c == 'A');
+                ctx->view.mode = made > 0 ? MODE_INSERT : MODE_NORMAL;
+                if (made > 1) editor_set_status_msg(ctx, "-- INSERT -- %d cursors", made);
+            }
+            break;
+
         /* Copy selection */
         case 'y':
             copy_selection_to_clipboard(ctx);
@@ -798,8 +1055,12 @@ static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
 
         /* Delete selection (yank first for 'd', just delete for 'x') */
         case 'd':
-            copy_selection_to_clipboard(ctx); /* Save to clipboard first (yank) */
             {
+                /* Save to clipboard first (yank), which clears the
+                 * selection once copied */
+                int active = ctx->view.sel_active;
+                copy_selection_to_clipboard(ctx);
+                ctx->view.sel_active = active;
                 int deleted = delete_selection(ctx);
                 editor_set_status_msg(ctx, "Deleted %d characters", deleted);
             }
@@ -813,6 +1074,38 @@ static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
             ctx->view.mode = MODE_NORMAL;
             break;
 
+        /* Command on the selected rows: ":'<,'>" */
+        case ':': {
+            int start = ctx->view.sel_start_y, end = ctx->view.sel_end_y;
+            if (ctx->view.vmark_set) {
+                marks_del(ctx->model.marks, ctx->view.vmark_start);
+                marks_del(ctx->model.marks, ctx->view.vmark_end);
+            }
+            ctx->view.vmark_start = editor_mark_add(&ctx->model,
+                                                    start < end ? start : end, 0, 0);
+            ctx->view.vmark_end = editor_mark_add(&ctx->model,
+                                                  start < end ? end : start, 0, 0);
+            ctx->view.vmark_set = 1;
+            ctx->view.sel_active = 0;
+            command_mode_enter(ctx);
+            strcpy(ctx->view.cmd_buffer, ":'<,'>");
+            ctx->view.cmd_length = ctx->view.cmd_cursor_pos =
+                (int)strlen(ctx->view.cmd_buffer);
+            editor_set_status_msg(ctx, "%s", ctx->view.cmd_buffer);
+            break;
+        }
+
+        /* Fold the selected rows: zf */
+        case 'z':
+            ctx->view.pending_prefix = 'z';
+            break;
+
+        /* Grow to the syntax node around the selection, or shrink back */
+        case '+':
+        case '-':
+            select_syntax_node(ctx, c == '+');
+            break;
+
         /* Global commands */
         case CTRL_C:
             copy_selection_to_clipboard(ctx);
@@ -823,6 +1116,8 @@ static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
             editor_set_status_msg(ctx, "Unknown visual command");
             break;
     }
+    if (ctx->view.mode != MODE_VISUAL) ctx->view.sel_block = 0;
+    if (c != '+' && c != '-') ctx->view.sel_grown = 0;
     (void)fd; /* Unused */
 }
 
@@ -837,13 +1132,13 @@ static void process_visual_mode(editor_ctx_t *ctx, int fd, int c) {
  * For non-terminal input sources, use modal_process_event() directly.
  */
 void modal_process_keypress(editor_ctx_t *ctx, int fd) {
-    int c = terminal_read_key(fd);
+    EditorEvent ev = event_read_terminal(fd);
+    int c = event_to_keycode(&ev);
 
     /* Handle pending Ctrl-X prefix - read second key immediately from terminal */
     if (ctx->view.pending_prefix == CTRL_X) {
         /* Already have Ctrl-X pending, this key completes the sequence.
-         * Convert to event and let modal_process_event() handle it. */
-        EditorEvent ev = event_from_keycode(c);
+         * Let modal_process_event() handle it. */
         modal_process_event(ctx, &ev);
         return;
     }
@@ -859,8 +1154,7 @@ void modal_process_keypress(editor_ctx_t *ctx, int fd) {
         }
     }
 
-    /* Convert keypress to event and delegate to event handler */
-    EditorEvent ev = event_from_keycode(c);
+    /* Delegate to event handler */
     modal_process_event(ctx, &ev);
 }
 
@@ -918,14 +1212,12 @@ static int handle_ctrl_x_command(editor_ctx_t *ctx, int c) {
         default:
             if (c >= '1' && c <= '9') {
                 /* Switch to buffer by number (1-9) */
-                int ids[MAX_BUFFERS];
-                int count = buffer_get_list(ids);
-                int index = c - '1';
-                if (index < count) {
-                    buffer_switch(ids[index]);
-                    editor_set_status_msg(ctx, "Switched to buffer %d", ids[index]);
+                int id = buffer_get_id_at(c - '1');
+                if (id >= 0) {
+                    buffer_switch(id);
+                    editor_set_status_msg(ctx, "Switched to buffer %d", id);
                 } else {
-                    editor_set_status_msg(ctx, "Buffer %d not found", index + 1);
+                    editor_set_status_msg(ctx, "Buffer %d not found", c - '0');
                 }
                 return 1;
             }
@@ -933,6 +1225,57 @@ static int handle_ctrl_x_command(editor_ctx_t *ctx, int c) {
     }
 }
 
+/* Handle the key after 'z': zf folds the visual selection (without one,
+ * the syntax node at the cursor); zo, zc and za open, close or toggle the
+ * fold at the cursor; zR, zM and zE open, close or remove them all. */
+static void handle_fold_command(editor_ctx_t *ctx, int c) {
+    int filerow = ctx->view.rowoff + ctx->view.cy;
+    FoldSet *folds = ctx->model.folds;
+    int changed = 1;
+
+    switch (c) {
+        case 'f': {
+            if (ctx->view.mode != MODE_VISUAL) {
+                /* Without a selection, the syntax node at the cursor */
+                int head = fold_syntax_at(ctx, filerow);
+                if (head == -2) {
+                    editor_set_status_msg(ctx, "zf folds a visual selection");
+                    return;
+                }
+                changed = head >= 0;
+                if (changed && head < filerow) editor_cursor_to(ctx, head, 0);
+                break;
+            }
+            int first = ctx->view.sel_start_y, last = ctx->view.sel_end_y;
+            if (first > last) {
+                int t = first;
+                first = last;
+                last = t;
+            }
+            ctx->view.mode = MODE_NORMAL;
+            ctx->view.sel_active = 0;
+            ctx->view.sel_block = 0;
+            if (editor_fold_add(&ctx->model, first, last, 1) != 0) {
+                editor_set_status_msg(ctx, "Cannot fold those lines");
+                return;
+            }
+            ctx->view.cy = first - ctx->view.rowoff;
+            break;
+        }
+        case 'o': changed = fold_open(folds, filerow); break;
+        case 'c': changed = fold_close(folds, filerow); break;
+        case 'a': changed = fold_toggle(folds, filerow); break;
+        case 'R': changed = fold_count(folds) > 0; fold_set_all(folds, 0); break;
+        case 'M': changed = fold_count(folds) > 0; fold_set_all(folds, 1); break;
+        case 'E': fold_clear(folds); break;
+        default:
+            editor_set_status_msg(ctx, "Unknown fold command");
+            return;
+    }
+    if (!changed) editor_set_status_msg(ctx, "No fold found");
+    editor_view_fix(ctx);
+}
+
 /* ============================================================================
  * Event-Based Entry Point
  * ============================================================================
@@ -940,6 +1283,203 @@ static int handle_ctrl_x_command(editor_ctx_t *ctx, int c) {
  * enabling cleaner modifier handling and test injection.
  */
 
+static void process_event(editor_ctx_t *ctx, const EditorEvent *event);
+
+/* Put pasted text in at the cursor as one edit (one undo step, one
+ * render), whatever the mode, without the auto-indentation typed text
+ * gets; a single line goes in at every cursor when there are several.
+ * A prompt (the REPL, an ex command) takes its first line as typed keys
+ * instead, printable ASCII only. */
+static void modal_paste(editor_ctx_t *ctx, const char *text, size_t len) {
+    if ((ctx_repl(ctx) && ctx_repl(ctx)->active) || ctx->view.mode == MODE_COMMAND) {
+        for (size_t i = 0; i < len && text[i] != '\n'; i++) {
+            unsigned char c = (unsigned char)text[i];
+            if (c < 32 || c >= 127) continue;
+            EditorEvent key = event_key(c, MOD_NONE);
+            modal_process_event(ctx, &key);
+        }
+        return;
+    }
+    if (len > 0 && multicursor_count(ctx) > 0 && ctx->view.mode == MODE_INSERT &&
+        !memchr(text, '\n', len)) {
+        /* One line goes in at every cursor */
+        multicursor_insert(ctx, text, len);
+        return;
+    }
+    multicursor_clear(ctx);
+    if (len > 0) editor_insert_text(ctx, text, len);
+}
+
+/* Is key 'c' a cursor motion in the current mode, one that does nothing
+ * more if it stops moving the cursor? */
+static int is_motion_key(editor_ctx_t *ctx, int c) {
+    if ((ctx_repl(ctx) && ctx_repl(ctx)->active) || ctx->view.pending_prefix) return 0;
+    if (ctx->view.mode == MODE_COMMAND) return 0;
+
+    LuaHost *host = ctx->lua_host;
+    if (host && host->L && host->keymaps && c >= 0 && c < LUA_KEYMAP_KEYS &&
+        host->keymaps->refs[ctx->view.mode][c] != LUA_NOREF)
+        return 0;
+
+    switch (c) {
+        case ARROW_LEFT: case ARROW_RIGHT: case ARROW_UP: case ARROW_DOWN:
+            return 1;
+        case 'h': case 'j': case 'k': case 'l':
+            return ctx->view.mode != MODE_INSERT;
+    }
+    return 0;
+}
+
+/* A key pressed event_repeat() times in a row, applied in one go like a
+ * vim count: no frame or event between the steps. A motion stops once it
+ * no longer moves the cursor (a key held past the end of the file);
+ * anything else (typed text, a keymap) runs once per press. */
+static void modal_process_repeat(editor_ctx_t *ctx, const EditorEvent *event) {
+    EditorEvent once = *event;
+    once.data.key.repeat = 1;
+    int motion = is_motion_key(ctx, event_to_keycode(&once));
+
+    for (int i = event_repeat(event); i > 0; i--) {
+        int cx = ctx->view.cx, cy = ctx->view.cy;
+        int rowoff = ctx->view.rowoff, coloff = ctx->view.coloff;
+        modal_process_event(ctx, &once);
+        if (motion && cx == ctx->view.cx && cy == ctx->view.cy &&
+            rowoff == ctx->view.rowoff && coloff == ctx->view.coloff)
+            break;
+    }
+}
+
+/* ============================================================================
+ * Mouse
+ * ============================================================================
+ * A left click puts the cursor on the char clicked, dragging from it
+ * selects in visual mode, and the wheel scrolls the view. Scrolling only
+ * moves rowoff: the renderer sees the text rows move as a block and
+ * scrolls them on the terminal, drawing the rows exposed. Bursts of wheel
+ * turns and drags come as one event (see event_read_terminal()).
+ */
+
+/* Lines a notch of the wheel scrolls */
+#define MOUSE_WHEEL_LINES 3
+
+/* Scroll the view 'lines' down (up if < 0), as far as the last row at the
+ * bottom, keeping the cursor in it. */
+static void mouse_scroll(editor_ctx_t *ctx, int lines) {
+    FoldSet *folds = ctx->model.folds;
+    int last = ctx->model.numrows - 1;
+    if (last < 0 || lines == 0) return;
+
+    int max_top = fold_screen_row(folds, last) - ctx->view.screenrows + 1;
+    max_top = max_top > 0 ? fold_row(folds, max_top) : 0;
+    int top = fold_head(folds, ctx->view.rowoff);
+    for (; lines > 0 && top < max_top; lines--) top = fold_next(folds, top);
+    for (; lines < 0 && top > 0; lines++) top = fold_prev(folds, top);
+
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    int bottom = fold_row(folds, fold_screen_row(folds, top) + ctx->view.screenrows - 1);
+    if (bottom > last) bottom = last;
+    if (row < top) row = top;
+    else if (row > bottom) row = fold_head(folds, bottom);
+    if (row <= last && col > ctx->model.row[row].size) col = ctx->model.row[row].size;
+    ctx->view.rowoff = top;
+    editor_cursor_to(ctx, row, col);
+    lazy_follow_cursor(ctx);
+}
+
+/* Put the cursor on the char drawn in 1-based cell x, y. Returns 0 if the
+ * cell is not over text (tab bar, gutter, past the last row). With 'clamp'
+ * (a drag) a cell off the text is taken as its nearest one, and one above
+ * or below the text rows scrolls the view a line that way. */
+static int mouse_move_cursor(editor_ctx_t *ctx, int x, int y, int clamp) {
+    int click_row = y - 1;  /* 1-based to 0-based */
+    int click_col = x - 1;
+
+    /* Account for tab bar if multiple buffers */
+    int tab_offset = (buffer_count() > 1) ? 1 : 0;
+    click_row -= tab_offset;
+
+    /* Account for gutter (line numbers) */
+    click_col -= editor_gutter_width(ctx);
+
+    if (clamp) {
+        if (click_row < 0) {
+            mouse_scroll(ctx, -1);
+            click_row = 0;
+        } else if (click_row >= ctx->view.screenrows) {
+            mouse_scroll(ctx, 1);
+            click_row = ctx->view.screenrows - 1;
+        }
+        if (click_col < 0) click_col = 0;
+    }
+    if (click_row < 0 || click_col < 0 || ctx->model.numrows == 0) return 0;
+
+    /* Convert screen position to file position */
+    int start;
+    int file_row = editor_screen_row_to_row(ctx, click_row, &start);
+    if (file_row >= ctx->model.numrows) {
+        if (!clamp) return 0;
+        file_row = ctx->model.numrows - 1;
+        start = -1;
+    }
+    ctx->view.cy = file_row - ctx->view.rowoff;
+    /* A wrapped row's screen rows start at 'start' */
+    if (start >= 0) ctx->view.coloff = 0;
+    else start = ctx->view.coloff;
+    /* The char drawn in the clicked cell (TABs, UTF-8) */
+    t_erow *row = &ctx->model.row[file_row];
+    int file_col = editor_row_cell_to_cx(row, start, click_col);
+    ctx->view.cx = file_col - ctx->view.coloff;
+    if (ctx->view.cx < 0) ctx->view.cx = 0;
+    return 1;
+}
+
+static void mouse_select_to_cursor(editor_ctx_t *ctx) {
+    ctx->view.sel_end_x = ctx->view.coloff + ctx->view.cx;
+    ctx->view.sel_end_y = ctx->view.rowoff + ctx->view.cy;
+}
+
+static void modal_mouse(editor_ctx_t *ctx, const EditorEvent *event) {
+    EditorMode mode = ctx->view.mode;
+    int x = event->data.mouse.x, y = event->data.mouse.y;
+
+    switch (event->data.mouse.kind) {
+        case MOUSE_WHEEL:
+            mouse_scroll(ctx, event->data.mouse.wheel * MOUSE_WHEEL_LINES);
+            if (mode == MODE_VISUAL) mouse_select_to_cursor(ctx);
+            break;
+
+        case MOUSE_PRESS:
+            if (event->data.mouse.button != 0 || !mouse_move_cursor(ctx, x, y, 0)) break;
+            /* A click ends a selection */
+            if (mode == MODE_VISUAL) {
+                ctx->view.mode = MODE_NORMAL;
+                ctx->view.sel_active = 0;
+                ctx->view.sel_block = 0;
+            }
+            break;
+
+        case MOUSE_DRAG:
+            if (event->data.mouse.button != 0) break;
+            if (mode != MODE_VISUAL) {
+                if (mode != MODE_NORMAL && mode != MODE_INSERT) break;
+                /* From where the button went down */
+                ctx->view.mode = MODE_VISUAL;
+                ctx->view.sel_active = 1;
+                ctx->view.sel_block = 0;
+                ctx->view.sel_grown = 0;
+                ctx->view.sel_start_x = ctx->view.coloff + ctx->view.cx;
+                ctx->view.sel_start_y = ctx->view.rowoff + ctx->view.cy;
+            }
+            mouse_move_cursor(ctx, x, y, 1);
+            mouse_select_to_cursor(ctx);
+            break;
+
+        case MOUSE_RELEASE:
+            break;
+    }
+}
+
 /**
  * Process an EditorEvent through the modal system.
  *
@@ -956,6 +1496,20 @@ static int handle_ctrl_x_command(editor_ctx_t *ctx, int c) {
  * Use modal_process_keypress() for full terminal functionality.
  */
 void modal_process_event(editor_ctx_t *ctx, const EditorEvent *event) {
+    uint64_t span = trace_begin();
+    if (event && macro_recording()) macro_record(event);
+    EditorMode was = ctx ? ctx->view.mode : MODE_NORMAL;
+    process_event(ctx, event);
+    /* Unless the key closed the buffer */
+    if (ctx && was == MODE_INSERT && (buffer_count() == 0 || buffer_get_current() == ctx) &&
+        ctx->view.mode != MODE_INSERT)
+        autocmd_fire(ctx, AUTOCMD_INSERT_LEAVE);
+    autocmd_note_input();
+    trace_end("modal_process_event", span);
+}
+
+/* The work of modal_process_event() */
+static void process_event(editor_ctx_t *ctx, const EditorEvent *event) {
     if (!ctx || !event) return;
 
     /* Handle non-key events directly */
@@ -984,53 +1538,20 @@ void modal_process_event(editor_ctx_t *ctx, const EditorEvent *event) {
             /* Named actions could be dispatched here in the future */
             return;
 
+        case EVENT_PASTE:
+            modal_paste(ctx, event->data.paste.text, event->data.paste.len);
+            return;
+
         case EVENT_KEY:
+            if (event_repeat(event) > 1) {
+                modal_process_repeat(ctx, event);
+                return;
+            }
             /* Fall through to keypress handling */
             break;
 
         case EVENT_MOUSE:
-            /* Handle mouse click to position cursor */
-            if (event->data.mouse.pressed && event->data.mouse.button == 0) {
-                /* Left click - position cursor */
-                int click_row = event->data.mouse.y - 1;  /* 1-based to 0-based */
-                int click_col = event->data.mouse.x - 1;
-
-                /* Account for tab bar if multiple buffers */
-                int tab_offset = (buffer_count() > 1) ? 1 : 0;
-                click_row -= tab_offset;
-
-                /* Account for gutter (line numbers) */
-                int gutter_width = 0;
-                if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-                    int max_line = ctx->model.numrows;
-                    gutter_width = 1;
-                    while (max_line >= 10) { gutter_width++; max_line /= 10; }
-                    gutter_width += 1;
-                }
-                click_col -= gutter_width;
-
-                if (click_row >= 0 && click_col >= 0) {
-                    /* Convert screen position to file position */
-                    int file_row = ctx->view.rowoff + click_row;
-                    if (file_row < ctx->model.numrows) {
-                        ctx->view.cy = click_row;
-                        /* Convert screen column to file column (handle tabs) */
-                        t_erow *row = &ctx->model.row[file_row];
-                        int file_col = 0;
-                        int screen_col = 0;
-                        while (file_col < row->size && screen_col < click_col + ctx->view.coloff) {
-                            if (row->chars[file_col] == '\t') {
-                                screen_col += 7 - (screen_col % 8) + 1;  /* Tab width = 8 */
-                            } else {
-                                screen_col++;
-                            }
-                            if (screen_col <= click_col + ctx->view.coloff) file_col++;
-                        }
-                        ctx->view.cx = file_col;
-                        if (ctx->view.cx > row->size) ctx->view.cx = row->size;
-                    }
-                }
-            }
+            modal_mouse(ctx, event);
             return;
     }
 
@@ -1051,6 +1572,16 @@ void modal_process_event(editor_ctx_t *ctx, const EditorEvent *event) {
         /* If not a valid Ctrl-X command, fall through to normal processing */
     }
 
+    /* Handle pending z prefix (folds) */
+    if (ctx->view.pending_prefix == 'z') {
+        ctx->view.pending_prefix = 0;
+        if (ctx->view.mode == MODE_NORMAL || ctx->view.mode == MODE_VISUAL) {
+            handle_fold_command(ctx, c);
+            quit_times = KILO_QUIT_TIMES;
+            return;
+        }
+    }
+
     /* REPL keypress handling */
     if (ctx_repl(ctx) && ctx_repl(ctx)->active) {
         lua_repl_handle_keypress(ctx, c);
@@ -1076,7 +1607,7 @@ void modal_process_event(editor_ctx_t *ctx, const EditorEvent *event) {
             buffer_switch(new_id);
             editor_set_status_msg(ctx, "Created buffer %d", new_id);
         } else {
-            editor_set_status_msg(ctx, "Error: Could not create buffer (max %d buffers)", MAX_BUFFERS);
+            editor_set_status_msg(ctx, "Error: Could not create buffer");
         }
         quit_times = KILO_QUIT_TIMES;
         return;
@@ -0,0 +1,133 @@
+/* model_snapshot.c - Read-only versions of a buffer for other threads
+ *
+ * A snapshot holds a share of each row's contents. The buffer's latest
+ * snapshot is remembered in model.snapshot (not a reference), and
+ * forgotten at its next change (editor_snapshot_note_change()), or when
+ * the snapshot goes. Snapshots let go of off their buffer's thread are
+ * pushed on a lock-free list for editor_snapshot_reap().
+ */
+
+#include "model_snapshot.h"
+#include "internal.h"
+#include <uv.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct EditorSnapshot {
+    atomic_int refs;
+    int numrows;
+    RowShare **rows;
+    uv_thread_t owner;          /* Thread of the buffer */
+    EditorModel *model;         /* Whose model.snapshot it is, or NULL */
+    EditorSnapshot *next_dead;  /* On the reap list */
+};
+
+static atomic_uintptr_t dead;   /* Let go of off their thread (EditorSnapshot *) */
+
+static void snapshot_free(EditorSnapshot *snap) {
+    if (snap->model && snap->model->snapshot == snap) snap->model->snapshot = NULL;
+    for (int i = 0; i < snap->numrows; i++) editor_row_share_release(snap->rows[i]);
+    free(snap->rows);
+    free(snap);
+}
+
+void editor_snapshot_reap(void) {
+    EditorSnapshot *snap = (EditorSnapshot *)atomic_exchange(&dead, 0);
+    while (snap) {
+        EditorSnapshot *next = snap->next_dead;
+        snapshot_free(snap);
+        snap = next;
+    }
+}
+
+void editor_snapshot_note_change(EditorModel *model) {
+    if (model->snapshot == NULL) return;
+    model->snapshot->model = NULL;
+    model->snapshot = NULL;
+}
+
+EditorSnapshot *editor_model_snapshot(editor_ctx_t *ctx) {
+    EditorModel *model = &ctx->model;
+    editor_snapshot_reap();
+
+    /* Unchanged since the last, which is still held somewhere: that one,
+     * unless its last holder let go of it meanwhile */
+    EditorSnapshot *snap = model->snapshot;
+    if (snap) {
+        int refs = atomic_load(&snap->refs);
+        while (refs > 0 && !atomic_compare_exchange_weak(&snap->refs, &refs, refs + 1))
+            ;
+        if (refs > 0) return snap;
+        editor_snapshot_note_change(model);
+    }
+
+    snap = calloc(1, sizeof(*snap));
+    if (snap) snap->rows = malloc(sizeof(RowShare *) * (size_t)(model->numrows ? model->numrows : 1));
+    if (!snap || !snap->rows) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int i = 0; i < model->numrows; i++)
+        snap->rows[i] = editor_row_share(model, &model->row[i]);
+    snap->numrows = model->numrows;
+    snap->owner = uv_thread_self();
+    snap->model = model;
+    atomic_init(&snap->refs, 1);
+    model->snapshot = snap;
+    return snap;
+}
+
+EditorSnapshot *editor_snapshot_retain(EditorSnapshot *snap) {
+    if (snap) atomic_fetch_add(&snap->refs, 1);
+    return snap;
+}
+
+void editor_snapshot_release(EditorSnapshot *snap) {
+    if (!snap || atomic_fetch_sub(&snap->refs, 1) > 1) return;
+
+    uv_thread_t self = uv_thread_self();
+    if (uv_thread_equal(&self, &snap->owner)) {
+        snapshot_free(snap);
+        return;
+    }
+    uintptr_t head = atomic_load(&dead);
+    do {
+        snap->next_dead = (EditorSnapshot *)head;
+    } while (!atomic_compare_exchange_weak(&dead, &head, (uintptr_t)snap));
+}
+
+int editor_snapshot_numrows(const EditorSnapshot *snap) {
+    return snap ? snap->numrows : 0;
+}
+
+const char *editor_snapshot_row(const EditorSnapshot *snap, int i, size_t *len) {
+    if (!snap || i < 0 || i >= snap->numrows) {
+        if (len) *len = 0;
+        return NULL;
+    }
+    if (len) *len = (size_t)snap->rows[i]->len;
+    return snap->rows[i]->chars;
+}
+
+char *editor_snapshot_text(const EditorSnapshot *snap, size_t *len) {
+    size_t total = 0;
+    int numrows = editor_snapshot_numrows(snap);
+    for (int i = 0; i < numrows; i++) total += (size_t)snap->rows[i]->len + 1;
+
+    char *text = malloc(total + 1);
+    if (!text) {
+        perror("Out of memory");
+        exit(1);
+    }
+    size_t off = 0;
+    for (int i = 0; i < numrows; i++) {
+        memcpy(text + off, snap->rows[i]->chars, (size_t)snap->rows[i]->len);
+        off += (size_t)snap->rows[i]->len;
+        text[off++] = '\n';
+    }
+    text[off] = '\0';
+    if (len) *len = off;
+    return text;
+}
@@ -0,0 +1,52 @@
+/* model_snapshot.h - Read-only versions of a buffer for other threads
+ *
+ * editor_model_snapshot() gives the text of a buffer as it is now, to be
+ * read from any thread while the buffer goes on being edited. It copies
+ * no text: each row's contents become shared with the buffer (see
+ * editor_row_share()), and the buffer copies a row only when it next
+ * writes to it, so a snapshot costs a pointer per row, and contents
+ * shared once stay shared for the snapshots after. A buffer not edited
+ * since its last snapshot, still held, gets that one again, in O(1).
+ *
+ * Snapshots are counted: editor_snapshot_retain() and
+ * editor_snapshot_release() may be called from any thread. The shares go
+ * back to the buffer's thread (the one that took the snapshot): a
+ * snapshot let go of elsewhere waits for editor_snapshot_reap(), which
+ * runs as snapshots are taken and buffers freed.
+ */
+
+#ifndef LOKI_MODEL_SNAPSHOT_H
+#define LOKI_MODEL_SNAPSHOT_H
+
+#include <stddef.h>
+#include "loki/core.h"
+
+typedef struct EditorSnapshot EditorSnapshot;
+struct EditorModel;
+
+/* The text of 'ctx' as it is now, with a reference for the caller */
+EditorSnapshot *editor_model_snapshot(editor_ctx_t *ctx);
+
+/* Take another reference. Returns 'snap'. */
+EditorSnapshot *editor_snapshot_retain(EditorSnapshot *snap);
+
+/* Let go of a reference (NULL is ignored) */
+void editor_snapshot_release(EditorSnapshot *snap);
+
+int editor_snapshot_numrows(const EditorSnapshot *snap);
+
+/* Row 'i' (0 .. numrows-1): its bytes, null terminated, with the length
+ * in *len; NULL (and 0) past the end */
+const char *editor_snapshot_row(const EditorSnapshot *snap, int i, size_t *len);
+
+/* The rows joined, each followed by a newline, as a new string (its
+ * length in *len if not NULL) */
+char *editor_snapshot_text(const EditorSnapshot *snap, size_t *len);
+
+/* Free the snapshots let go of on other threads. On the buffers' thread. */
+void editor_snapshot_reap(void);
+
+/* The text of 'model' changed: its next snapshot is a new one */
+void editor_snapshot_note_change(struct EditorModel *model);
+
+#endif /* LOKI_MODEL_SNAPSHOT_H */
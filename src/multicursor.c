@@ -0,0 +1,238 @@
+/* multicursor.c - Editing at many cursors at once
+ *
+ * See multicursor.h. The view's own cursor is not in view.cursors; an
+ * edit gathers it with the others in document order, applies the edit
+ * row by row, and puts the cursors back where the edit leaves them.
+ */
+
+#include "multicursor.h"
+#include "internal.h"
+#include "terminal.h"
+#include "undo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int cursor_cmp(const CursorPos *a, const CursorPos *b) {
+    if (a->row != b->row) return a->row < b->row ? -1 : 1;
+    return a->col < b->col ? -1 : a->col > b->col;
+}
+
+static void reserve_cursors(EditorView *view, int n) {
+    if (n <= view->cursor_cap) return;
+    int cap = view->cursor_cap ? view->cursor_cap : 16;
+    while (cap < n) cap *= 2;
+    CursorPos *p = realloc(view->cursors, sizeof(*p) * (size_t)cap);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    view->cursors = p;
+    view->cursor_cap = cap;
+}
+
+int multicursor_count(const editor_ctx_t *ctx) {
+    return ctx->view.cursor_count;
+}
+
+/* Index of the first extra cursor at or after 'at' */
+static int cursor_lower_bound(const EditorView *view, const CursorPos *at) {
+    int lo = 0, hi = view->cursor_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cursor_cmp(&view->cursors[mid], at) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void multicursor_add(editor_ctx_t *ctx, int row, int col) {
+    EditorView *view = &ctx->view;
+    CursorPos at = { row, col };
+    if (row == view->rowoff + view->cy && col == view->coloff + view->cx) return;
+    int i = cursor_lower_bound(view, &at);
+    if (i < view->cursor_count && cursor_cmp(&view->cursors[i], &at) == 0) return;
+    reserve_cursors(view, view->cursor_count + 1);
+    memmove(view->cursors + i + 1, view->cursors + i,
+            sizeof(*view->cursors) * (size_t)(view->cursor_count - i));
+    view->cursors[i] = at;
+    view->cursor_count++;
+    view->cursors_gen++;
+}
+
+void multicursor_clear(editor_ctx_t *ctx) {
+    if (ctx->view.cursor_count == 0) return;
+    ctx->view.cursor_count = 0;
+    ctx->view.cursors_gen++;
+}
+
+void multicursor_free(EditorView *view) {
+    free(view->cursors);
+    view->cursors = NULL;
+    view->cursor_count = view->cursor_cap = 0;
+}
+
+int multicursor_on_row(const editor_ctx_t *ctx, int row, int *col) {
+    const EditorView *view = &ctx->view;
+    CursorPos at = { row, 0 };
+    int i = cursor_lower_bound(view, &at);
+    if (i == view->cursor_count || view->cursors[i].row != row) return 0;
+    *col = view->cursors[i].col;
+    return 1;
+}
+
+/* Every cursor, the view's own at index *own, in document order. Returns
+ * a malloc'ed array of *n. */
+static CursorPos *gather(editor_ctx_t *ctx, int *n, int *own) {
+    EditorView *view = &ctx->view;
+    CursorPos me = { view->rowoff + view->cy, view->coloff + view->cx };
+    CursorPos *all = malloc(sizeof(*all) * (size_t)(view->cursor_count + 1));
+    if (all == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int i = cursor_lower_bound(view, &me), k = i;
+    memcpy(all, view->cursors, sizeof(*all) * (size_t)i);
+    *own = k;
+    all[k++] = me;
+    if (i < view->cursor_count && cursor_cmp(&view->cursors[i], &me) == 0) i++;
+    memcpy(all + k, view->cursors + i, sizeof(*all) * (size_t)(view->cursor_count - i));
+    *n = k + view->cursor_count - i;
+    return all;
+}
+
+/* Put the cursors back from 'all' (still in document order), merging
+ * those that met, and free it */
+static void scatter(editor_ctx_t *ctx, CursorPos *all, int n, int own) {
+    EditorView *view = &ctx->view;
+    CursorPos me = all[own];
+    reserve_cursors(view, n);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == own || cursor_cmp(&all[i], &me) == 0) continue;
+        if (count > 0 && cursor_cmp(&view->cursors[count - 1], &all[i]) == 0) continue;
+        view->cursors[count++] = all[i];
+    }
+    view->cursor_count = count;
+    view->cursors_gen++;
+    free(all);
+    editor_cursor_to(ctx, me.row, me.col);
+}
+
+static int clamp_col(int col, int size) {
+    return col < 0 ? 0 : (col > size ? size : col);
+}
+
+int multicursor_insert(editor_ctx_t *ctx, const char *text, size_t len) {
+    if (len == 0) return 0;
+    int n, own;
+    CursorPos *all = gather(ctx, &n, &own);
+    undo_rows_t undo = {0};
+    struct abuf line = ABUF_INIT;
+    int rows = 0;
+
+    for (int i = 0; i < n; ) {
+        int r = all[i].row, j = i;
+        while (j < n && all[j].row == r) j++;
+        t_erow *row = model_row(&ctx->model, r);
+        if (row) {
+            /* The row with the text at each of its cursors */
+            line.len = 0;
+            terminal_buffer_reserve(&line, row->size + (j - i) * (int)len + 1);
+            int prev = 0;
+            for (int k = i; k < j; k++) {
+                int col = clamp_col(all[k].col, row->size);
+                terminal_buffer_append(&line, row->chars + prev, col - prev);
+                terminal_buffer_append(&line, text, (int)len);
+                prev = col;
+                all[k].col = col + (k - i + 1) * (int)len;
+            }
+            terminal_buffer_append(&line, row->chars + prev, row->size - prev);
+            undo_rows_set(&undo, ctx, r, line.b, line.len);
+            rows++;
+        }
+        i = j;
+    }
+    undo_record_replace_rows(ctx, &undo);
+    terminal_buffer_free(&line);
+    scatter(ctx, all, n, own);
+    return rows;
+}
+
+int multicursor_backspace(editor_ctx_t *ctx) {
+    int n, own;
+    CursorPos *all = gather(ctx, &n, &own);
+    undo_rows_t undo = {0};
+    struct abuf line = ABUF_INIT;
+    int rows = 0;
+
+    for (int i = 0; i < n; ) {
+        int r = all[i].row, j = i;
+        while (j < n && all[j].row == r) j++;
+        t_erow *row = model_row(&ctx->model, r);
+        if (row) {
+            /* The row without the byte before each of its cursors */
+            line.len = 0;
+            terminal_buffer_reserve(&line, row->size + 1);
+            int prev = 0, removed = 0;
+            for (int k = i; k < j; k++) {
+                int col = clamp_col(all[k].col, row->size);
+                if (col > prev) {
+                    terminal_buffer_append(&line, row->chars + prev, col - 1 - prev);
+                    prev = col;
+                    removed++;
+                }
+                all[k].col = col - removed;
+            }
+            if (removed) {
+                terminal_buffer_append(&line, row->chars + prev, row->size - prev);
+                undo_rows_set(&undo, ctx, r, line.b, line.len);
+                rows++;
+            }
+        }
+        i = j;
+    }
+    undo_record_replace_rows(ctx, &undo);
+    terminal_buffer_free(&line);
+    scatter(ctx, all, n, own);
+    return rows;
+}
+
+void multicursor_move(editor_ctx_t *ctx, int dx) {
+    int n, own;
+    CursorPos *all = gather(ctx, &n, &own);
+    for (int i = 0; i < n; i++) {
+        const t_erow *row = model_row(&ctx->model, all[i].row);
+        all[i].col = clamp_col(all[i].col + dx, row ? row->size : 0);
+    }
+    scatter(ctx, all, n, own);
+}
+
+int multicursor_from_block(editor_ctx_t *ctx, int append) {
+    EditorView *view = &ctx->view;
+    if (!view->sel_active || !view->sel_block) return 0;
+
+    int y0 = view->sel_start_y, y1 = view->sel_end_y;
+    int x0 = view->sel_start_x, x1 = view->sel_end_x;
+    if (y0 > y1) { int t = y0; y0 = y1; y1 = t; }
+    if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+
+    multicursor_clear(ctx);
+    view->sel_active = 0;
+    view->sel_block = 0;
+    int made = 0;
+    for (int y = y0 < 0 ? 0 : y0; y <= y1 && y < ctx->model.numrows; y++) {
+        int size = ctx->model.row[y].size;
+        if (!append && size < x0) continue;
+        int col = append ? clamp_col(x1 + 1, size) : x0;
+        if (made++ == 0) {
+            editor_cursor_to(ctx, y, col);
+        } else {
+            /* Rows in order, so each goes last */
+            reserve_cursors(view, view->cursor_count + 1);
+            view->cursors[view->cursor_count++] = (CursorPos){ y, col };
+        }
+    }
+    view->cursors_gen++;
+    return made;
+}
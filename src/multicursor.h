@@ -0,0 +1,59 @@
+/* multicursor.h - Editing at many cursors at once
+ *
+ * A view can hold cursors besides its own (view.cx, view.cy), in
+ * view.cursors: visual block 'I' and 'A' put one on every row of the
+ * block. In INSERT mode, typing, backspace and left/right then act at
+ * all of them, the view's own included.
+ *
+ * An edit is applied per row, not per cursor: each row with cursors on it
+ * is rebuilt once with every cursor's change and set with editor_row_set()
+ * (one allocation, one highlight update), and the keystroke is recorded
+ * for undo as one entry (undo_record_replace_rows()) however many cursors
+ * it touched. A column edit at 10k cursors is 10k row rebuilds, not 10k
+ * inserts that each re-highlight.
+ *
+ * Cursors are kept in document order, each position once; a cursor that
+ * lands on another merges with it.
+ */
+
+#ifndef LOKI_MULTICURSOR_H
+#define LOKI_MULTICURSOR_H
+
+#include "internal.h"
+#include <stddef.h>
+
+/* Extra cursors of the view (its own not counted) */
+int multicursor_count(const editor_ctx_t *ctx);
+
+/* Add a cursor at document position (row, col), unless one is there */
+void multicursor_add(editor_ctx_t *ctx, int row, int col);
+
+/* Drop the extra cursors, keeping the view's own */
+void multicursor_clear(editor_ctx_t *ctx);
+
+/* Free the cursors of 'view' (a view set aside, or about to go) */
+void multicursor_free(EditorView *view);
+
+/* Put a cursor on every row of the visual block, at its left column, or
+ * past its right one with 'append' (or at the end of a shorter row). Rows
+ * too short to reach the left column get none. The view's own cursor
+ * goes to the first; the selection ends. Returns the cursors made, the
+ * view's own included. */
+int multicursor_from_block(editor_ctx_t *ctx, int append);
+
+/* Insert the 'len' bytes at 'text', without newlines, at every cursor.
+ * Returns the rows changed. */
+int multicursor_insert(editor_ctx_t *ctx, const char *text, size_t len);
+
+/* Delete the byte before every cursor (backspace), within its row.
+ * Returns the rows changed. */
+int multicursor_backspace(editor_ctx_t *ctx);
+
+/* Move every cursor 'dx' columns, within its row */
+void multicursor_move(editor_ctx_t *ctx, int dx);
+
+/* The column of the first extra cursor on 'row', for drawing. Returns 0
+ * if there is none. */
+int multicursor_on_row(const editor_ctx_t *ctx, int row, int *col);
+
+#endif /* LOKI_MULTICURSOR_H */
@@ -0,0 +1,155 @@
+/* perfhud.c - Performance HUD
+ *
+ * See perfhud.h for an overview.
+ */
+
+#include "perfhud.h"
+#include "async_queue.h"
+#include "lua_profile.h"
+#ifdef LOKI_ENABLE_HTTP
+#include "http.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct {
+    int on;
+    uint64_t samples[PERFHUD_METRICS][PERFHUD_FRAMES];
+    int next;                   /* Slot of the next frame's sample */
+    int frames;
+    uint64_t build_ns;          /* Spans since the last frame */
+    uint64_t syntax_ns;
+    uint64_t lua_ns;            /* Lua time at the last frame */
+} hud;
+
+/* Time spent in Lua so far, over every entry point */
+static uint64_t lua_total_ns(void) {
+    uint64_t total = 0;
+    for (int e = 0; e < LUA_PROFILE_ENTRIES; e++) {
+        LuaProfileEntryStats st;
+        lua_profile_get_entry((LuaProfileEntry)e, &st);
+        total += st.total_ns;
+    }
+    return total;
+}
+
+void perfhud_set(int on) {
+    if (on && !hud.on) {
+        memset(&hud, 0, sizeof(hud));
+        hud.lua_ns = lua_total_ns();
+    }
+    hud.on = on ? 1 : 0;
+}
+
+int perfhud_enabled(void) {
+    return hud.on;
+}
+
+void perfhud_span(const char *name, uint64_t ns) {
+    if (!hud.on) return;
+    if (strcmp(name, "rows") == 0) hud.build_ns += ns;
+    else if (strcmp(name, "syntax") == 0) hud.syntax_ns += ns;
+}
+
+void perfhud_frame(size_t bytes, int rows) {
+    if (!hud.on) return;
+    uint64_t lua = lua_total_ns();
+    uint64_t sample[PERFHUD_METRICS] = {
+        [PERFHUD_BUILD_NS] = hud.build_ns,
+        [PERFHUD_BYTES] = bytes,
+        [PERFHUD_ROWS] = rows > 0 ? (uint64_t)rows : 0,
+        [PERFHUD_SYNTAX_NS] = hud.syntax_ns,
+        [PERFHUD_LUA_NS] = lua - hud.lua_ns,
+        [PERFHUD_QUEUE] = (uint64_t)async_queue_count(NULL),
+#ifdef LOKI_ENABLE_HTTP
+        [PERFHUD_HTTP] = (uint64_t)loki_http_pending_count(),
+#endif
+    };
+    for (int m = 0; m < PERFHUD_METRICS; m++) hud.samples[m][hud.next] = sample[m];
+    hud.next = (hud.next + 1) % PERFHUD_FRAMES;
+    if (hud.frames < PERFHUD_FRAMES) hud.frames++;
+    hud.build_ns = hud.syntax_ns = 0;
+    hud.lua_ns = lua;
+}
+
+int perfhud_frames(void) {
+    return hud.frames;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void perfhud_get(PerfHudMetric metric, PerfHudStat *stat) {
+    memset(stat, 0, sizeof(*stat));
+    if ((unsigned)metric >= PERFHUD_METRICS || hud.frames == 0) return;
+    uint64_t sorted[PERFHUD_FRAMES];
+    memcpy(sorted, hud.samples[metric], (size_t)hud.frames * sizeof(sorted[0]));
+    qsort(sorted, (size_t)hud.frames, sizeof(sorted[0]), cmp_u64);
+    stat->last = hud.samples[metric][(hud.next + PERFHUD_FRAMES - 1) % PERFHUD_FRAMES];
+    /* Nearest rank */
+    stat->p50 = sorted[(hud.frames * 50 + 99) / 100 - 1];
+    stat->p99 = sorted[(hud.frames * 99 + 99) / 100 - 1];
+}
+
+/* "p50/p99" of a count, in k from 10000 */
+static int format_count(char *buf, size_t size, uint64_t p50, uint64_t p99) {
+    char a[16], b[16];
+    if (p50 >= 10000) snprintf(a, sizeof(a), "%.1fk", (double)p50 / 1024);
+    else snprintf(a, sizeof(a), "%llu", (unsigned long long)p50);
+    if (p99 >= 10000) snprintf(b, sizeof(b), "%.1fk", (double)p99 / 1024);
+    else snprintf(b, sizeof(b), "%llu", (unsigned long long)p99);
+    return snprintf(buf, size, "%s/%s", a, b);
+}
+
+int perfhud_format(char *buf, size_t size) {
+    static const struct {
+        PerfHudMetric metric;
+        const char *label;
+        int time;
+    } fields[] = {
+        {PERFHUD_BUILD_NS, "build", 1},
+        {PERFHUD_BYTES, "out", 0},
+        {PERFHUD_ROWS, "rows", 0},
+        {PERFHUD_SYNTAX_NS, "hl", 1},
+        {PERFHUD_LUA_NS, "lua", 1},
+        {PERFHUD_QUEUE, "q", 0},
+        {PERFHUD_HTTP, "http", 0},
+    };
+    int len = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        PerfHudStat st;
+        perfhud_get(fields[i].metric, &st);
+        char value[40];
+        if (fields[i].time)
+            snprintf(value, sizeof(value), "%.2f/%.2fms", (double)st.p50 / 1e6,
+                     (double)st.p99 / 1e6);
+        else
+            format_count(value, sizeof(value), st.p50, st.p99);
+        int n = snprintf(buf + len, size > (size_t)len ? size - (size_t)len : 0,
+                         "%s%s %s", i ? " " : "", fields[i].label, value);
+        if (n > 0) len += n;
+    }
+    return len;
+}
+
+const char *perfhud_message_line(const char *msg, int cols, char *buf, size_t size) {
+    if (!hud.on || cols <= 0 || size == 0) return msg;
+    char line[256];
+    int hlen = perfhud_format(line, sizeof(line));
+    if (hlen >= (int)sizeof(line)) hlen = (int)sizeof(line) - 1;
+    if ((size_t)cols >= size) cols = (int)size - 1;
+    if (hlen > cols) hlen = cols;
+
+    /* The message up to the HUD, padded to it, then the HUD */
+    int at = cols - hlen;
+    int mlen = msg ? (int)strlen(msg) : 0;
+    if (mlen > at) mlen = at;
+    if (mlen > 0) memcpy(buf, msg, (size_t)mlen);
+    memset(buf + mlen, ' ', (size_t)(at - mlen));
+    memcpy(buf + at, line, (size_t)hlen);
+    buf[cols] = '\0';
+    return buf;
+}
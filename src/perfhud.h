@@ -0,0 +1,73 @@
+/* perfhud.h - Performance HUD (:set perfhud)
+ *
+ * A line of live figures drawn over the right end of the message line,
+ * through the renderer like the rest of the frame:
+ *
+ *   - build: time to build the frame (the "rows" span)
+ *   - out: bytes written to the terminal for it
+ *   - rows: rows segmented again rather than repeated
+ *   - hl: time bringing highlighting up to date (the "syntax" span)
+ *   - lua: time in Lua since the frame before (lua_profile.h entries)
+ *   - q: async events queued, and http: requests pending, at the frame
+ *
+ * each as the median and p99 of the last PERFHUD_FRAMES frames. The times
+ * are those of the spans the trace exporter writes (trace.h): while the
+ * HUD is on, trace_begin() and trace_end() time them whether or not a
+ * trace is being written, and hand them over here. Off, nothing is timed.
+ */
+
+#ifndef LOKI_PERFHUD_H
+#define LOKI_PERFHUD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Frames the percentiles are taken over */
+#define PERFHUD_FRAMES 128
+
+typedef enum {
+    PERFHUD_BUILD_NS,
+    PERFHUD_BYTES,
+    PERFHUD_ROWS,
+    PERFHUD_SYNTAX_NS,
+    PERFHUD_LUA_NS,
+    PERFHUD_QUEUE,
+    PERFHUD_HTTP,
+    PERFHUD_METRICS
+} PerfHudMetric;
+
+typedef struct PerfHudStat {
+    uint64_t last;
+    uint64_t p50;
+    uint64_t p99;
+} PerfHudStat;
+
+/* Turn the HUD on or off; turning it on starts from no frames */
+void perfhud_set(int on);
+
+/* Is the HUD on? */
+int perfhud_enabled(void);
+
+/* A span of the trace exporter ended, having taken 'ns' */
+void perfhud_span(const char *name, uint64_t ns);
+
+/* A frame was drawn, writing 'bytes' and segmenting 'rows' rows: take
+ * the frame's sample, the spans since the last one included */
+void perfhud_frame(size_t bytes, int rows);
+
+/* Frames sampled (up to PERFHUD_FRAMES) */
+int perfhud_frames(void);
+
+/* The last sample of 'metric' and its percentiles (all zero with none) */
+void perfhud_get(PerfHudMetric metric, PerfHudStat *stat);
+
+/* The HUD as one line, "build 0.41/1.20ms out 3.1k/9.8k ...". Returns its
+ * length, like snprintf(). */
+int perfhud_format(char *buf, size_t size);
+
+/* The message line to draw for 'msg' (NULL for none) on 'cols' columns:
+ * 'msg' itself with the HUD off, else the HUD at its right end, over as
+ * much of the message as it needs. Returns 'msg' or 'buf'. */
+const char *perfhud_message_line(const char *msg, int cols, char *buf, size_t size);
+
+#endif /* LOKI_PERFHUD_H */
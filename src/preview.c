@@ -0,0 +1,435 @@
+/* preview.c - Markdown previews in a browser, kept live
+ *
+ * See preview.h. The editor's thread owns the debounce and the render;
+ * the server's thread owns its loop, the listener and the connections.
+ * They share the HTML published and its version, under a mutex, and the
+ * server is woken through a uv_async_t to tell the /events followers
+ * (or to close everything down).
+ *
+ * Responses other than /events are written whole with Content-Length,
+ * and the connection shut down after them.
+ */
+
+#include "preview.h"
+#include "internal.h"
+#include "loki_markdown.h"
+#include <uv.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parse and render options of the preview (raw HTML is left out) */
+#define PREVIEW_MD_OPTIONS LOKI_MD_OPT_DEFAULT
+
+/* Longest request read, headers and all */
+#define PREVIEW_REQUEST_SIZE 8192
+
+/* Most connections listen() lets wait to be accepted */
+#define PREVIEW_BACKLOG 64
+
+typedef struct PreviewConn {
+    uv_tcp_t tcp;
+    struct Preview *preview;
+    char req[PREVIEW_REQUEST_SIZE + 1];
+    size_t len;
+    int events;                 /* Following /events */
+    int closing;
+    uv_shutdown_t shutdown;
+    struct PreviewConn *next;
+} PreviewConn;
+
+typedef struct {
+    uv_write_t req;
+    char *data;
+} PreviewWrite;
+
+typedef struct Preview {
+    /* The editor's thread */
+    editor_ctx_t *ctx;
+    int port;
+    unsigned long edits;        /* The cache's edit count when last seen */
+    int stale;                  /* Edited since the last render started */
+    uint64_t due;               /* When to render it (uv_hrtime()) */
+    int rendering;
+
+    /* Shared */
+    uv_mutex_t lock;            /* Guards html, html_len and version */
+    char *html;
+    size_t html_len;
+    unsigned version;
+    atomic_int stopping;
+    uv_async_t wake;
+
+    /* The server's thread */
+    uv_thread_t thread;
+    uv_loop_t loop;
+    uv_tcp_t listener;
+    unsigned sent;              /* Version the followers were told of */
+    PreviewConn *conns;
+} Preview;
+
+static Preview *preview = NULL;
+
+static const char page[] =
+    "<!DOCTYPE html>\n"
+    "<html><head><meta charset=\"utf-8\"><title>Preview</title>\n"
+    "<style>body{max-width:48em;margin:2em auto;padding:0 1em;"
+    "font-family:sans-serif;line-height:1.5}pre{overflow:auto}</style>\n"
+    "</head><body><div id=\"content\"></div>\n"
+    "<script>\n"
+    "var content = document.getElementById('content');\n"
+    "new EventSource('/events').onmessage = function () {\n"
+    "  fetch('/content').then(function (r) { return r.text(); })\n"
+    "    .then(function (html) { content.innerHTML = html; });\n"
+    "};\n"
+    "</script></body></html>\n";
+
+/* ======================= Connections ======================================= */
+
+static void on_write(uv_write_t *req, int status) {
+    PreviewWrite *w = (PreviewWrite *)req;
+    (void)status;
+    free(w->data);
+    free(w);
+}
+
+/* Write the 'len' bytes at 'data' (malloc'ed; the write frees them) */
+static void conn_send(PreviewConn *conn, char *data, size_t len) {
+    PreviewWrite *w = malloc(sizeof(*w));
+    if (!w) {
+        perror("Out of memory");
+        exit(1);
+    }
+    w->data = data;
+    uv_buf_t buf = uv_buf_init(data, (unsigned int)len);
+    if (uv_write(&w->req, (uv_stream_t *)&conn->tcp, &buf, 1, on_write) != 0) {
+        free(data);
+        free(w);
+    }
+}
+
+static void on_conn_closed(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+/* Forget the connection, and close its socket */
+static void conn_close(PreviewConn *conn) {
+    if (uv_is_closing((uv_handle_t *)&conn->tcp)) return;
+    for (PreviewConn **p = &conn->preview->conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    conn->closing = 1;
+    uv_close((uv_handle_t *)&conn->tcp, on_conn_closed);
+}
+
+static void on_shutdown(uv_shutdown_t *req, int status) {
+    (void)status;
+    conn_close(req->data);
+}
+
+/* Close once what was written to it is sent */
+static void conn_end(PreviewConn *conn) {
+    if (conn->closing) return;
+    conn->closing = 1;
+    uv_read_stop((uv_stream_t *)&conn->tcp);
+    conn->shutdown.data = conn;
+    if (uv_shutdown(&conn->shutdown, (uv_stream_t *)&conn->tcp, on_shutdown) != 0)
+        conn_close(conn);
+}
+
+static void conn_respond(PreviewConn *conn, const char *status, const char *type,
+                         const char *body, size_t len) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Connection: close\r\n\r\n", status, type, len);
+    char *data = malloc((size_t)n + len);
+    if (!data) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(data, head, (size_t)n);
+    if (len) memcpy(data + n, body, len);
+    conn_send(conn, data, (size_t)n + len);
+    conn_end(conn);
+}
+
+/* Tell a follower of /events of 'version' */
+static void conn_event(PreviewConn *conn, unsigned version) {
+    char *data = malloc(32);
+    if (!data) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int n = snprintf(data, 32, "data: %u\n\n", version);
+    conn_send(conn, data, (size_t)n);
+}
+
+static int is_path(const char *path, size_t len, const char *want) {
+    return strlen(want) == len && memcmp(path, want, len) == 0;
+}
+
+/* Answer the request read, whole, into conn->req */
+static void conn_request(PreviewConn *conn) {
+    Preview *p = conn->preview;
+    if (strncmp(conn->req, "GET ", 4) != 0) {
+        conn_respond(conn, "405 Method Not Allowed", "text/plain", "", 0);
+        return;
+    }
+    const char *path = conn->req + 4;
+    size_t len = strcspn(path, " ?\r\n");
+
+    if (is_path(path, len, "/")) {
+        conn_respond(conn, "200 OK", "text/html; charset=utf-8", page, sizeof(page) - 1);
+    } else if (is_path(path, len, "/content")) {
+        uv_mutex_lock(&p->lock);
+        size_t n = p->html_len;
+        char *html = malloc(n + 1);
+        if (!html) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (n) memcpy(html, p->html, n);
+        uv_mutex_unlock(&p->lock);
+        conn_respond(conn, "200 OK", "text/html; charset=utf-8", html, n);
+        free(html);
+    } else if (is_path(path, len, "/events")) {
+        static const char head[] = "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: text/event-stream\r\n"
+                                   "Cache-Control: no-cache\r\n"
+                                   "Connection: keep-alive\r\n\r\n";
+        char *data = malloc(sizeof(head) - 1);
+        if (!data) {
+            perror("Out of memory");
+            exit(1);
+        }
+        memcpy(data, head, sizeof(head) - 1);
+        conn_send(conn, data, sizeof(head) - 1);
+        conn->events = 1;
+
+        /* One event now, for the page to fetch what there is */
+        uv_mutex_lock(&p->lock);
+        unsigned version = p->version;
+        uv_mutex_unlock(&p->lock);
+        conn_event(conn, version);
+    } else {
+        conn_respond(conn, "404 Not Found", "text/plain", "Not found\n", 10);
+    }
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    PreviewConn *conn = handle->data;
+    (void)suggested;
+    size_t room = PREVIEW_REQUEST_SIZE - conn->len;
+    if (room == 0) {
+        /* Past the request, or too long a one: read and drop */
+        static char drop[1024];
+        *buf = uv_buf_init(drop, sizeof(drop));
+        return;
+    }
+    *buf = uv_buf_init(conn->req + conn->len, (unsigned int)room);
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    PreviewConn *conn = stream->data;
+    if (conn->closing) return;
+    if (nread < 0) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->events || buf->base != conn->req + conn->len) return;
+
+    conn->len += (size_t)nread;
+    conn->req[conn->len] = '\0';
+    if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n")) {
+        conn_request(conn);
+    } else if (conn->len == PREVIEW_REQUEST_SIZE) {
+        conn_respond(conn, "431 Request Header Fields Too Large", "text/plain", "", 0);
+    }
+}
+
+static void on_connection(uv_stream_t *listener, int status) {
+    Preview *p = listener->data;
+    if (status < 0) return;
+
+    PreviewConn *conn = calloc(1, sizeof(*conn));
+    if (!conn) return;
+    conn->preview = p;
+    uv_tcp_init(&p->loop, &conn->tcp);
+    conn->tcp.data = conn;
+    if (uv_accept(listener, (uv_stream_t *)&conn->tcp) != 0) {
+        uv_close((uv_handle_t *)&conn->tcp, on_conn_closed);
+        return;
+    }
+    conn->next = p->conns;
+    p->conns = conn;
+    uv_read_start((uv_stream_t *)&conn->tcp, on_alloc, on_read);
+}
+
+/* ======================= Server ============================================ */
+
+/* A new version is published, or the preview stops */
+static void on_wake(uv_async_t *handle) {
+    Preview *p = handle->data;
+    if (atomic_load(&p->stopping)) {
+        while (p->conns) conn_close(p->conns);
+        uv_close((uv_handle_t *)&p->listener, NULL);
+        uv_close((uv_handle_t *)&p->wake, NULL);
+        return;
+    }
+    uv_mutex_lock(&p->lock);
+    unsigned version = p->version;
+    uv_mutex_unlock(&p->lock);
+    if (version == p->sent) return;
+    p->sent = version;
+    for (PreviewConn *c = p->conns; c; c = c->next) {
+        if (c->events && !c->closing) conn_event(c, version);
+    }
+}
+
+static void server_main(void *arg) {
+    Preview *p = arg;
+    uv_run(&p->loop, UV_RUN_DEFAULT);
+}
+
+/* Hand 'html' (malloc'ed) to the server, unless it is what it has */
+static void publish(Preview *p, char *html) {
+    size_t len = strlen(html);
+    uv_mutex_lock(&p->lock);
+    if (p->html && p->html_len == len && memcmp(p->html, html, len) == 0) {
+        uv_mutex_unlock(&p->lock);
+        free(html);
+        return;
+    }
+    free(p->html);
+    p->html = html;
+    p->html_len = len;
+    p->version++;
+    uv_mutex_unlock(&p->lock);
+    uv_async_send(&p->wake);
+}
+
+/* Wait for the render running, if any, and drop its HTML */
+static void render_drop(Preview *p) {
+    loki_markdown_cache *cache = p->ctx->model.md_cache;
+    char *html;
+    if (p->rendering && cache) {
+        loki_markdown_cache_render_wait(cache);
+        if (loki_markdown_cache_render_poll(cache, &html) == 1) free(html);
+    }
+    p->rendering = 0;
+}
+
+int preview_start(editor_ctx_t *ctx, int port, char *err, size_t err_size) {
+    if (preview && (port == 0 || port == preview->port)) {
+        render_drop(preview);
+        preview->ctx = ctx;
+        preview->stale = 1;
+        preview->due = 0;
+        return preview->port;
+    }
+    preview_stop();
+
+    Preview *p = calloc(1, sizeof(*p));
+    if (!p) {
+        snprintf(err, err_size, "Out of memory");
+        return -1;
+    }
+    uv_loop_init(&p->loop);
+    uv_tcp_init(&p->loop, &p->listener);
+    p->listener.data = p;
+
+    struct sockaddr_in addr;
+    int rc = uv_ip4_addr("127.0.0.1", port, &addr);
+    if (rc == 0) rc = uv_tcp_bind(&p->listener, (const struct sockaddr *)&addr, 0);
+    if (rc == 0) rc = uv_listen((uv_stream_t *)&p->listener, PREVIEW_BACKLOG, on_connection);
+    if (rc == 0) {
+        struct sockaddr_in bound;
+        int len = sizeof(bound);
+        rc = uv_tcp_getsockname(&p->listener, (struct sockaddr *)&bound, &len);
+        p->port = ntohs(bound.sin_port);
+    }
+    if (rc == 0) {
+        uv_async_init(&p->loop, &p->wake, on_wake);
+        p->wake.data = p;
+        uv_mutex_init(&p->lock);
+        if (uv_thread_create(&p->thread, server_main, p) != 0) {
+            uv_mutex_destroy(&p->lock);
+            uv_close((uv_handle_t *)&p->wake, NULL);
+            rc = UV_EAGAIN;
+        }
+    }
+    if (rc != 0) {
+        snprintf(err, err_size, "127.0.0.1:%d: %s", port, uv_strerror(rc));
+        uv_close((uv_handle_t *)&p->listener, NULL);
+        uv_run(&p->loop, UV_RUN_DEFAULT);
+        uv_loop_close(&p->loop);
+        free(p);
+        return -1;
+    }
+
+    p->ctx = ctx;
+    p->stale = 1;               /* Render it right away */
+    preview = p;
+    return p->port;
+}
+
+void preview_stop(void) {
+    Preview *p = preview;
+    if (!p) return;
+    preview = NULL;
+    render_drop(p);
+    atomic_store(&p->stopping, 1);
+    uv_async_send(&p->wake);
+    uv_thread_join(&p->thread);
+    uv_loop_close(&p->loop);
+    uv_mutex_destroy(&p->lock);
+    free(p->html);
+    free(p);
+}
+
+int preview_port(void) {
+    return preview ? preview->port : -1;
+}
+
+void preview_detach(editor_ctx_t *ctx) {
+    if (preview && preview->ctx == ctx) preview_stop();
+}
+
+int preview_tick(uint64_t now) {
+    Preview *p = preview;
+    if (!p) return -1;
+    EditorModel *model = &p->ctx->model;
+
+    if (p->rendering) {
+        char *html;
+        int done = model->md_cache ? loki_markdown_cache_render_poll(model->md_cache, &html) : -1;
+        if (done == 0) return PREVIEW_POLL_MS;
+        p->rendering = 0;
+        if (done == 1) publish(p, html);
+    }
+
+    /* Edits, or a cache dropped (the buffer reloaded): wait for a pause */
+    unsigned long edits = loki_markdown_cache_edits(model);
+    if (edits != p->edits || (!p->stale && model->md_cache == NULL)) {
+        p->edits = edits;
+        p->stale = 1;
+        p->due = now + (uint64_t)PREVIEW_DEBOUNCE_MS * 1000000;
+    }
+    if (!p->stale) return -1;
+    if (now < p->due) return (int)((p->due - now) / 1000000) + 1;
+
+    p->stale = 0;
+    loki_markdown_cache *cache = loki_markdown_cache_get(model, PREVIEW_MD_OPTIONS);
+    p->edits = loki_markdown_cache_edits(model);
+    if (loki_markdown_cache_render_start(cache, PREVIEW_MD_OPTIONS) != 0) return -1;
+    p->rendering = 1;
+    return PREVIEW_POLL_MS;
+}
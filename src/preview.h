@@ -0,0 +1,54 @@
+/* preview.h - Markdown previews in a browser, kept live
+ *
+ * :preview serves the buffer, rendered as Markdown, on a local HTTP port
+ * (127.0.0.1 only):
+ *
+ * - /          a page that shows the rendering and keeps it current;
+ * - /content   the rendering, as HTML;
+ * - /events    a text/event-stream with an event each time the rendering
+ *              changes, which the page follows to fetch /content again.
+ *
+ * Rendering never waits in the keypress path. Edits are noted by the
+ * buffer's Markdown cache (loki_markdown.h); once they pause for
+ * PREVIEW_DEBOUNCE_MS, a tick brings the cache up to date, which reparses
+ * only the blocks edited, and renders it on a thread of its own, which
+ * renders only the blocks reparsed. The HTML is then handed to the
+ * server, which runs its own libuv loop on a thread of its own too.
+ *
+ * There is one preview at a time, of one buffer.
+ */
+
+#ifndef LOKI_PREVIEW_H
+#define LOKI_PREVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "loki/core.h"
+
+/* Quiet time after an edit before the preview is rendered again */
+#define PREVIEW_DEBOUNCE_MS 150
+
+/* How often a render running is polled for */
+#define PREVIEW_POLL_MS 10
+
+/* Preview 'ctx' on 'port' (0: one the system picks). A preview running
+ * on that port (or with 'port' 0, on any) moves to 'ctx'; one on another
+ * is stopped first. Returns the port, or -1 with 'err' set. */
+int preview_start(editor_ctx_t *ctx, int port, char *err, size_t err_size);
+
+/* Stop the preview, closing its connections */
+void preview_stop(void);
+
+/* The port previewed on, or -1 if there is no preview */
+int preview_port(void);
+
+/* 'ctx' is about to be freed: stop previewing it */
+void preview_detach(editor_ctx_t *ctx);
+
+/* Render the preview again if edits have paused, and hand on a finished
+ * render, as due at 'now' (uv_hrtime()). Returns the milliseconds until
+ * the next tick is due, or -1 if there is nothing to do until the next
+ * edit. */
+int preview_tick(uint64_t now);
+
+#endif /* LOKI_PREVIEW_H */
@@ -0,0 +1,657 @@
+/* recovery.c - Unsaved changes kept on disk against a crash
+ *
+ * See recovery.h for an overview. Each journal is written through its
+ * own descriptor, appended to on the main thread; a sync job syncs
+ * duplicates of the descriptors with changes on a thread of its own, so
+ * a journal can be closed, removed or replaced while it runs.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE     /* realpath(), fsync() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <uv.h>
+
+#include "recovery.h"
+#include "internal.h"
+#include "undo.h"
+#include "undo_journal.h"
+#include "serialize.h"
+#include "loki.h"
+
+/* "LKRC" and "LKRR", as read from a little-endian file */
+#define JOURNAL_MAGIC 0x43524B4C
+#define RECORD_MAGIC 0x52524B4C
+#define JOURNAL_VERSION 1
+
+/* Journals synced by one job at most; the rest wait for the next */
+#define RECOVERY_SYNC_MAX 64
+
+/* Record types */
+enum {
+    RECORD_BASE_FILE = 1,   /* Body: file_base */
+    RECORD_BASE_SNAPSHOT,   /* Body: a packed snapshot */
+    RECORD_GROUP,           /* Body: undo entries, applied forward */
+    RECORD_UNDO,            /* Body: undo entries, applied backwards */
+    RECORD_REDO,            /* Body: undo entries, applied forward */
+    RECORD_OPEN             /* Body: the open group so far */
+};
+
+/* The start of a journal; the file's absolute path follows ("" for none) */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;            /* Process writing it */
+    uint32_t path_len;
+} journal_header;
+
+/* The start of every record; its body follows */
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t size;           /* Bytes of body */
+    uint32_t crc;            /* CRC-32C of the body, then of this header
+                              * (crc 0) */
+    int32_t count;           /* Undo entries in the body */
+    int32_t reserved;
+} record_header;
+
+/* The file a journal's edits start from */
+typedef struct {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} file_base;
+
+/* What the text's unsaved changes start from */
+enum { BASE_NONE, BASE_FILE, BASE_SNAPSHOT };
+
+struct RecoveryJournal {
+    editor_ctx_t *ctx;
+    RecoveryJournal *next;   /* In the list ticks go through */
+    char *path;              /* The journal, if there is one (or one found) */
+    int fd;                  /* -1 until the first record */
+    size_t size;             /* Bytes written */
+    size_t base_size;        /* Of them, the header and the base */
+    int base;                /* BASE_* */
+    file_base file;          /* For BASE_FILE */
+    int found;               /* 'path' was left behind, and waits */
+    int writing;             /* Making a snapshot: records are ignored */
+    int written_dirty;       /* model.dirty as of the last record */
+    int unsynced;            /* Written since the last sync job began */
+};
+
+static RecoveryJournal *journals = NULL;
+static char *journal_dir = NULL;
+static int journal_dir_set = 0;
+static int unnamed_seq = 0;
+static uint64_t next_tick = 0;
+
+static struct {
+    uv_thread_t thread;
+    int running;
+    atomic_int done;
+    int fds[RECOVERY_SYNC_MAX];
+    int nfds;
+} sync_job;
+
+void recovery_set_dir(const char *dir) {
+    free(journal_dir);
+    journal_dir = dir ? strdup(dir) : NULL;
+    journal_dir_set = dir != NULL;
+}
+
+static char *resolve_dir(void) {
+    char dir[PATH_MAX];
+    struct stat st;
+    if (journal_dir_set) {
+        if (journal_dir == NULL || journal_dir[0] == '\0') return NULL;
+        snprintf(dir, sizeof(dir), "%s", journal_dir);
+    } else if (stat(LOKI_CONFIG_DIR, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(dir, sizeof(dir), "%s/recover", LOKI_CONFIG_DIR);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) return NULL;
+        snprintf(dir, sizeof(dir), "%s/%s", home, LOKI_CONFIG_DIR);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+        snprintf(dir, sizeof(dir), "%s/%s/recover", home, LOKI_CONFIG_DIR);
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+    return strdup(dir);
+}
+
+/* The journal for the file at 'abs' (NULL: a buffer without one) */
+static char *journal_path(const char *abs) {
+    char *dir = resolve_dir();
+    if (!dir) return NULL;
+    char name[PATH_MAX];
+    if (abs) {
+        uint64_t key = undo_journal_hash(UNDO_JOURNAL_HASH_INIT, abs, strlen(abs));
+        snprintf(name, sizeof(name), "%s/%016llx.rec", dir, (unsigned long long)key);
+    } else {
+        snprintf(name, sizeof(name), "%s/unnamed-%d-%d.rec", dir, (int)getpid(),
+                 ++unnamed_seq);
+    }
+    free(dir);
+    char *path = strdup(name);
+    if (!path) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return path;
+}
+
+static int stat_base(const char *filename, file_base *fb) {
+    struct stat st;
+    if (!filename || stat(filename, &st) != 0) return -1;
+    fb->size = (int64_t)st.st_size;
+    fb->mtime_sec = (int64_t)st.st_mtime;
+#ifdef __APPLE__
+    fb->mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+    fb->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+/* ======================== Writing ======================== */
+
+/* Close and remove the journal, if any */
+static void journal_drop(RecoveryJournal *j) {
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+        unlink(j->path);
+    }
+    free(j->path);
+    j->path = NULL;
+    j->size = j->base_size = 0;
+    j->unsynced = 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_header(int fd, const char *abs) {
+    journal_header hdr = { JOURNAL_MAGIC, JOURNAL_VERSION, (uint32_t)getpid(),
+                           abs ? (uint32_t)strlen(abs) : 0 };
+    if (write_all(fd, &hdr, sizeof(hdr)) == -1) return -1;
+    return hdr.path_len ? write_all(fd, abs, hdr.path_len) : 0;
+}
+
+static record_header record_for(int type, const void *body, size_t size, int count) {
+    record_header hdr = { RECORD_MAGIC, (uint32_t)type, (uint32_t)size, 0, count, 0 };
+    hdr.crc = snapshot_crc32c(snapshot_crc32c(0, body, size), &hdr, sizeof(hdr));
+    return hdr;
+}
+
+/* Append a record; a journal that cannot be written to is given up */
+static void append(RecoveryJournal *j, int type, const void *body, size_t size,
+                   int count) {
+    record_header hdr = record_for(type, body, size, count);
+    if (write_all(j->fd, &hdr, sizeof(hdr)) == -1 ||
+        (size && write_all(j->fd, body, size) == -1)) {
+        journal_drop(j);
+        j->base = BASE_NONE;
+        return;
+    }
+    j->size += sizeof(hdr) + size;
+    j->written_dirty = j->ctx->model.dirty;
+    j->unsynced = 1;
+}
+
+/* Start the journal of a buffer whose base is its file. Returns 0, or -1. */
+static int start_on_file(RecoveryJournal *j) {
+    char *abs = realpath(j->ctx->model.filename, NULL);
+    if (!abs) return -1;
+    j->path = journal_path(abs);
+    if (!j->path) {
+        free(abs);
+        return -1;
+    }
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    record_header hdr = record_for(RECORD_BASE_FILE, &j->file, sizeof(j->file), 0);
+    int ok = j->fd != -1 && write_header(j->fd, abs) == 0 &&
+             write_all(j->fd, &hdr, sizeof(hdr)) == 0 &&
+             write_all(j->fd, &j->file, sizeof(j->file)) == 0;
+    size_t size = sizeof(journal_header) + strlen(abs) + sizeof(hdr) + sizeof(j->file);
+    free(abs);
+    if (!ok) {
+        journal_drop(j);
+        return -1;
+    }
+    j->size = j->base_size = size;
+    j->unsynced = 1;
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint32_t crc;
+    size_t size;
+} snapshot_out;
+
+static int write_snapshot_part(void *opaque, const void *data, size_t len) {
+    snapshot_out *out = opaque;
+    out->crc = snapshot_crc32c(out->crc, data, len);
+    out->size += len;
+    return write_all(out->fd, data, len);
+}
+
+/* Write the journal again as a snapshot of the text, closing the open
+ * group first so that none of its entries comes after it. The new
+ * journal replaces the old one once it is on disk. */
+static void compact(RecoveryJournal *j) {
+    editor_ctx_t *ctx = j->ctx;
+    j->writing = 1;
+    undo_break_group(ctx);
+    j->writing = 0;
+
+    char *abs = ctx->model.filename ? realpath(ctx->model.filename, NULL) : NULL;
+    char *path = j->path ? strdup(j->path) : journal_path(abs);
+    if (!path) {
+        free(abs);
+        return;
+    }
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (!tmp) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sprintf(tmp, "%s.tmp", path);
+
+    /* The body streams out first; its header is filled in after */
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    size_t at = sizeof(journal_header) + (abs ? strlen(abs) : 0);
+    record_header hdr = { RECORD_MAGIC, RECORD_BASE_SNAPSHOT, 0, 0, 0, 0 };
+    snapshot_out out = { fd, 0, 0 };
+    int ok = fd != -1 && write_header(fd, abs) == 0 &&
+             write_all(fd, &hdr, sizeof(hdr)) == 0 &&
+             editor_model_write_packed(&ctx->model, write_snapshot_part, &out) == 0 &&
+             out.size <= UINT32_MAX;
+    free(abs);
+    if (ok) {
+        hdr.size = (uint32_t)out.size;
+        hdr.crc = snapshot_crc32c(out.crc, &hdr, sizeof(hdr));
+        ok = pwrite(fd, &hdr, sizeof(hdr), (off_t)at) == (ssize_t)sizeof(hdr) &&
+             fsync(fd) == 0 && rename(tmp, path) == 0;
+    }
+    if (!ok) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        free(path);
+        return;
+    }
+    free(tmp);
+
+    if (j->fd != -1) close(j->fd);
+    free(j->path);
+    j->path = path;
+    j->fd = fd;
+    j->size = j->base_size = at + sizeof(hdr) + out.size;
+    j->base = BASE_SNAPSHOT;
+    j->written_dirty = ctx->model.dirty;
+    j->unsynced = 0;
+}
+
+/* The undo history's recorder (see undo_set_recorder()) */
+static void record(void *data, int kind, const char *body, size_t size, int count) {
+    RecoveryJournal *j = data;
+    if (j->found || j->writing) return;
+
+    if (kind == UNDO_RECORD_RESET || kind == UNDO_RECORD_SAVED) {
+        /* The text starts over: from its file if it is the file's */
+        journal_drop(j);
+        EditorModel *model = &j->ctx->model;
+        j->base = !model->dirty && stat_base(model->filename, &j->file) == 0
+                      ? BASE_FILE : BASE_NONE;
+        j->written_dirty = model->dirty;
+        return;
+    }
+
+    /* Without a file to start from, the first tick makes a snapshot */
+    if (j->fd == -1 && (j->base != BASE_FILE || start_on_file(j) == -1)) return;
+    int type = kind == UNDO_RECORD_UNDO ? RECORD_UNDO
+             : kind == UNDO_RECORD_REDO ? RECORD_REDO : RECORD_GROUP;
+    append(j, type, body, size, count);
+}
+
+void recovery_attach(editor_ctx_t *ctx) {
+    RecoveryJournal *j = calloc(1, sizeof(*j));
+    if (!j) {
+        perror("Out of memory");
+        exit(1);
+    }
+    j->ctx = ctx;
+    j->fd = -1;
+    j->base = BASE_NONE;
+    j->next = journals;
+    journals = j;
+    ctx->model.recovery = j;
+    undo_set_recorder(ctx, record, j);
+}
+
+void recovery_detach(editor_ctx_t *ctx) {
+    RecoveryJournal *j = ctx->model.recovery;
+    if (!j) return;
+    undo_set_recorder(ctx, NULL, NULL);
+    if (!j->found) journal_drop(j);
+    free(j->path);
+
+    RecoveryJournal **pp = &journals;
+    while (*pp != j) pp = &(*pp)->next;
+    *pp = j->next;
+    free(j);
+    ctx->model.recovery = NULL;
+}
+
+/* ======================== Reading ======================== */
+
+/* A journal read through a mapping */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t start;            /* Offset of the first record */
+    uint32_t pid;
+} journal_map;
+
+static int map_journal(const char *path, journal_map *m) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(journal_header)) {
+        close(fd);
+        return -1;
+    }
+    m->len = (size_t)st.st_size;
+    void *map = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    m->data = map;
+
+    journal_header hdr;
+    memcpy(&hdr, m->data, sizeof(hdr));
+    if (hdr.magic != JOURNAL_MAGIC || hdr.version != JOURNAL_VERSION ||
+        hdr.path_len > m->len - sizeof(hdr)) {
+        munmap(map, m->len);
+        return -1;
+    }
+    m->start = sizeof(hdr) + hdr.path_len;
+    m->pid = hdr.pid;
+    return 0;
+}
+
+/* The record at 'off', checked. Returns the offset after it, or 0. */
+static size_t record_at(const journal_map *m, size_t off, record_header *hdr,
+                        const char **body) {
+    if (m->len - off < sizeof(*hdr)) return 0;
+    memcpy(hdr, m->data + off, sizeof(*hdr));
+    if (hdr->magic != RECORD_MAGIC || hdr->size > m->len - off - sizeof(*hdr))
+        return 0;
+    *body = m->data + off + sizeof(*hdr);
+    record_header check = *hdr;
+    check.crc = 0;
+    if (snapshot_crc32c(snapshot_crc32c(0, *body, hdr->size), &check, sizeof(check)) != hdr->crc)
+        return 0;
+    return off + sizeof(*hdr) + hdr->size;
+}
+
+int recovery_opened(editor_ctx_t *ctx) {
+    RecoveryJournal *j = ctx->model.recovery;
+    if (!j || !ctx->model.filename) return 0;
+    if (j->found) {
+        free(j->path);
+        j->path = NULL;
+        j->found = 0;
+    }
+    char *abs = realpath(ctx->model.filename, NULL);
+    char *path = abs ? journal_path(abs) : NULL;
+    free(abs);
+    journal_map m;
+    if (!path || map_journal(path, &m) != 0) {
+        free(path);
+        return 0;
+    }
+    munmap((void *)m.data, m.len);
+    if (m.pid == (uint32_t)getpid()) {
+        free(path);                 /* Another buffer's of ours */
+        return 0;
+    }
+
+    /* Kept aside, and kept from being overwritten, until dealt with */
+    journal_drop(j);
+    j->path = path;
+    j->found = 1;
+    if (kill((pid_t)m.pid, 0) == 0)
+        editor_set_status_msg(ctx, "%s has unsaved changes in process %u",
+                              ctx->model.filename, (unsigned)m.pid);
+    else
+        editor_set_status_msg(ctx, "Unsaved changes to %s were found: :recover to "
+                              "restore them, :recover! to discard them",
+                              ctx->model.filename);
+    return 1;
+}
+
+int recovery_found(editor_ctx_t *ctx) {
+    RecoveryJournal *j = ctx->model.recovery;
+    return j && j->found;
+}
+
+void recovery_discard(editor_ctx_t *ctx) {
+    RecoveryJournal *j = ctx->model.recovery;
+    if (!j || !j->found) return;
+    unlink(j->path);
+    free(j->path);
+    j->path = NULL;
+    j->found = 0;
+    j->base = !ctx->model.dirty && stat_base(ctx->model.filename, &j->file) == 0
+                  ? BASE_FILE : BASE_NONE;
+    j->written_dirty = ctx->model.dirty == 0 ? 0 : -1;
+}
+
+int recovery_replay(editor_ctx_t *ctx, char *err, size_t err_size) {
+    RecoveryJournal *j = ctx->model.recovery;
+    if (!j || !j->found) {
+        snprintf(err, err_size, "No unsaved changes to recover");
+        return -1;
+    }
+    journal_map m;
+    if (map_journal(j->path, &m) != 0) {
+        snprintf(err, err_size, "Can't read %s", j->path);
+        return -1;
+    }
+
+    /* The base first */
+    record_header hdr;
+    const char *body;
+    size_t off = record_at(&m, m.start, &hdr, &body);
+    int base = BASE_NONE;
+    file_base file;
+    if (off && hdr.type == RECORD_BASE_FILE && hdr.size == sizeof(file)) {
+        memcpy(&file, body, sizeof(file));
+        file_base now;
+        if (ctx->model.dirty || stat_base(ctx->model.filename, &now) != 0 ||
+            memcmp(&now, &file, sizeof(file)) != 0) {
+            munmap((void *)m.data, m.len);
+            snprintf(err, err_size, ctx->model.dirty
+                     ? "The buffer was modified: :e! it first"
+                     : "The file changed since; its unsaved changes don't apply");
+            return -1;
+        }
+        base = BASE_FILE;
+    } else if (off && hdr.type == RECORD_BASE_SNAPSHOT) {
+        char *filename = ctx->model.filename ? strdup(ctx->model.filename) : NULL;
+        if (editor_model_deserialize(&ctx->model, body, hdr.size) == 0) {
+            base = BASE_SNAPSHOT;
+            if (filename) {
+                free(ctx->model.filename);
+                ctx->model.filename = filename;     /* The one it is opened as */
+                filename = NULL;
+            }
+            editor_model_damage_shift(&ctx->model, 0);
+        }
+        free(filename);
+    }
+    if (base == BASE_NONE) {
+        munmap((void *)m.data, m.len);
+        snprintf(err, err_size, "%s is damaged", j->path);
+        return -1;
+    }
+    size_t base_size = off;
+
+    /* The edits, past any the history had: it no longer leads here */
+    undo_history_detach(ctx);
+    int applied = 0;
+    size_t open_at = 0, end = off;
+    while ((off = record_at(&m, end, &hdr, &body)) != 0) {
+        if (hdr.type == RECORD_OPEN) {
+            open_at = end;              /* Applied if nothing comes after */
+        } else if (hdr.type >= RECORD_GROUP && hdr.type <= RECORD_REDO) {
+            open_at = 0;
+            if (undo_replay(ctx, body, hdr.size, hdr.count, hdr.type == RECORD_UNDO) != 0)
+                break;
+            applied++;
+        } else {
+            break;
+        }
+        end = off;
+    }
+    if (open_at && record_at(&m, open_at, &hdr, &body) &&
+        undo_replay(ctx, body, hdr.size, hdr.count, 0) == 0)
+        applied++;
+    munmap((void *)m.data, m.len);
+    if (ctx->model.dirty == 0) ctx->model.dirty = 1;
+
+    /* Carry on in it, as ours, past the last good record */
+    int fd = open(j->path, O_RDWR);
+    uint32_t pid = (uint32_t)getpid();
+    if (fd == -1 || ftruncate(fd, (off_t)end) != 0 ||
+        pwrite(fd, &pid, sizeof(pid), offsetof(journal_header, pid)) != (ssize_t)sizeof(pid) ||
+        lseek(fd, 0, SEEK_END) == -1) {
+        if (fd != -1) close(fd);
+        recovery_discard(ctx);
+        j->base = BASE_NONE;
+        return applied;
+    }
+    j->found = 0;
+    j->fd = fd;
+    j->size = end;
+    j->base_size = base_size;
+    j->base = base;
+    if (base == BASE_FILE) j->file = file;
+    j->written_dirty = ctx->model.dirty;
+    if (open_at) {
+        /* The open group is part of the text now */
+        j->writing = 1;
+        undo_break_group(ctx);
+        j->writing = 0;
+    }
+    return applied;
+}
+
+/* ======================== Syncing ======================== */
+
+static void sync_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < sync_job.nfds; i++) {
+        fsync(sync_job.fds[i]);
+        close(sync_job.fds[i]);
+    }
+    atomic_store(&sync_job.done, 1);
+}
+
+/* Sync the journals written to since the last job, if none is running */
+static void start_sync(void) {
+    if (sync_job.running) {
+        if (!atomic_load(&sync_job.done)) return;
+        uv_thread_join(&sync_job.thread);
+        sync_job.running = 0;
+    }
+    sync_job.nfds = 0;
+    for (RecoveryJournal *j = journals; j && sync_job.nfds < RECOVERY_SYNC_MAX; j = j->next) {
+        if (!j->unsynced || j->fd == -1) continue;
+        int fd = dup(j->fd);
+        if (fd == -1) continue;
+        sync_job.fds[sync_job.nfds++] = fd;
+        j->unsynced = 0;
+    }
+    if (sync_job.nfds == 0) return;
+    atomic_store(&sync_job.done, 0);
+    if (uv_thread_create(&sync_job.thread, sync_worker, NULL) != 0) {
+        sync_worker(NULL);  /* Then here */
+        return;
+    }
+    sync_job.running = 1;
+}
+
+int recovery_tick(uint64_t now) {
+    int pending = sync_job.running;
+    for (RecoveryJournal *j = journals; j; j = j->next) {
+        if (j->found) continue;
+        if (j->ctx->model.dirty != j->written_dirty || j->unsynced) pending = 1;
+    }
+    if (!pending) return -1;
+    if (now < next_tick) return (int)((next_tick - now) / 1000000) + 1;
+    next_tick = now + (uint64_t)RECOVERY_TICK_MS * 1000000;
+
+    for (RecoveryJournal *j = journals; j; j = j->next) {
+        EditorModel *model = &j->ctx->model;
+        if (j->found || model->dirty == j->written_dirty) continue;
+        if (!model->dirty) {
+            /* Back to the text as saved, or a buffer made and left clean */
+            j->written_dirty = model->dirty;
+            continue;
+        }
+        if (j->fd == -1 && j->base != BASE_FILE) {
+            char *dir = resolve_dir();
+            if (!dir) {
+                j->written_dirty = model->dirty;    /* Journals are off */
+                continue;
+            }
+            free(dir);
+            compact(j);
+            continue;
+        }
+        const char *body;
+        size_t size;
+        int count;
+        if (!undo_open_group(j->ctx, &body, &size, &count)) {
+            j->written_dirty = model->dirty;
+            continue;
+        }
+        if (j->fd == -1 && start_on_file(j) == -1) {
+            j->written_dirty = model->dirty;
+            continue;
+        }
+        append(j, RECORD_OPEN, body, size, count);
+        if (j->fd != -1 && j->size - j->base_size > RECOVERY_COMPACT_SIZE) compact(j);
+    }
+    start_sync();
+    return RECOVERY_TICK_MS;
+}
@@ -0,0 +1,75 @@
+/* recovery.h - Unsaved changes kept on disk against a crash
+ *
+ * A buffer with unsaved changes keeps a journal of them in
+ * .loki/recover/ (the project's .loki/ if there is one, else ~/.loki/),
+ * named after a hash of its file's absolute path, or after the process
+ * for a buffer without a file. The journal starts with a base, then
+ * records the edits made since, each checksummed:
+ *
+ * - the base is either the file as last loaded or saved (its size and
+ *   modification time), or a packed snapshot of the text (see
+ *   serialize.h), for buffers whose text is not a file's;
+ * - an edit record holds undo entries as the undo history serializes
+ *   them (see undo_set_recorder()): a group done, undone or redone, or
+ *   the open group so far, which a later record supersedes.
+ *
+ * Records are appended as the undo history makes them, and the open
+ * group once a second while it grows. Writes go to the page cache; a
+ * helper thread syncs them to disk, so the UI never waits on the disk.
+ * Past RECOVERY_COMPACT_SIZE of edits, the journal is compacted: written
+ * again as a snapshot of the text. Saving the buffer, or closing it,
+ * removes its journal.
+ *
+ * A journal left behind for a file (by a crash, or a dropped terminal)
+ * is noticed when the file is opened again. :recover replays it, from
+ * the base, in time proportional to the edits in it; :recover! deletes
+ * it. While it waits, the buffer's own edits are not journaled, so it is
+ * not overwritten.
+ *
+ * Records are in the machine's byte order, as in undo_journal.h.
+ */
+
+#ifndef LOKI_RECOVERY_H
+#define LOKI_RECOVERY_H
+
+#include <stdint.h>
+#include "loki/core.h"
+
+/* How often the open group is written and journals synced */
+#define RECOVERY_TICK_MS 1000
+
+/* Bytes of edit records past which a journal is compacted */
+#define RECOVERY_COMPACT_SIZE (4u * 1024 * 1024)
+
+typedef struct RecoveryJournal RecoveryJournal;
+
+/* Keep journals in 'dir' (created if missing) instead of .loki/recover/,
+ * or turn them off with "". NULL goes back to the default. */
+void recovery_set_dir(const char *dir);
+
+/* Start journaling the edits of 'ctx' (after undo_init()), and stop,
+ * removing its journal, before it is freed. */
+void recovery_attach(editor_ctx_t *ctx);
+void recovery_detach(editor_ctx_t *ctx);
+
+/* ctx->model.filename was just loaded: look for a journal left behind
+ * for it, and say so in the status bar. Returns 1 if there is one. */
+int recovery_opened(editor_ctx_t *ctx);
+
+/* Whether a journal left behind waits for :recover in 'ctx' */
+int recovery_found(editor_ctx_t *ctx);
+
+/* Replay the journal found for 'ctx' into it. Returns the number of edit
+ * records applied, or -1 with 'err' set (the buffer is then unchanged,
+ * unless replaying failed part way). */
+int recovery_replay(editor_ctx_t *ctx, char *err, size_t err_size);
+
+/* Delete the journal found for 'ctx', and journal its edits again. */
+void recovery_discard(editor_ctx_t *ctx);
+
+/* Write the open groups and start syncing, if a tick is due at 'now'
+ * (uv_hrtime()). Returns the milliseconds until the next one is due, or
+ * -1 if there is nothing to do until the next edit. */
+int recovery_tick(uint64_t now);
+
+#endif /* LOKI_RECOVERY_H */
@@ -0,0 +1,960 @@
+/* regexp.c - Regular expressions matched in linear time
+ *
+ * See regexp.h for the syntax. A pattern is parsed into a tree, which is
+ * compiled twice into Thompson NFA programs: forwards, and backwards with
+ * every concatenation reversed. A search makes two passes over the text:
+ *
+ *   1. The forward program runs unanchored (a thread starts at every byte
+ *      until something matched) in leftmost-first order: threads are kept
+ *      by priority, and a thread reaching MATCH drops every thread after
+ *      it. When no thread is left, the last position a match was seen at
+ *      is the end of the match.
+ *   2. The reverse program runs backwards from that end, anchored there,
+ *      keeping every thread. The leftmost position where it matches is the
+ *      start: the leftmost match is the longest one ending there.
+ *
+ * Both programs run as DFAs built lazily. A DFA state is the ordered list
+ * of NFA threads; its transition on a byte is computed the first time the
+ * byte is seen there, after which a step is one table load. When more than
+ * RX_MAX_STATES states exist the cache is emptied and refilled as needed,
+ * so a step never costs more than a walk over the program. Patterns that
+ * start with a literal skip to its first occurrence with the substring
+ * search of search.c (ignoring case with REGEXP_ICASE) before running the
+ * DFA.
+ */
+
+#include "regexp.h"
+#include "search.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RX_MAX_INSTS 8192       /* Program size limit, per direction */
+#define RX_MAX_REPEAT 1000      /* Largest count in {m,n} */
+#define RX_MAX_DEPTH 100        /* Deepest nesting of groups */
+#define RX_MAX_STATES 1024      /* DFA states kept per program */
+#define RX_STATE_SLOTS 2048     /* Hash slots for them, a power of two */
+#define RX_PREFIX_MAX 64        /* Longest literal prefix to skip to */
+
+typedef struct RxClass {
+    uint32_t bits[8];
+} RxClass;
+
+/* ======================= Parse Tree ======================================== */
+
+enum { N_EMPTY, N_CLASS, N_CAT, N_ALT, N_REPEAT, N_BOL, N_EOL };
+
+typedef struct RxNode {
+    int type;
+    int cls;                  /* N_CLASS: index in the classes */
+    int a, b;                 /* Children, as node indices */
+    int min, max;             /* N_REPEAT counts, max -1 for no limit */
+    int greedy;
+} RxNode;
+
+typedef struct RxParser {
+    const char *p;
+    int icase;
+    int depth;
+    const char *error;
+    RxNode *nodes;
+    int nnodes, nodecap;
+    RxClass *classes;
+    int nclasses, classcap;
+} RxParser;
+
+static void *rx_realloc(void *p, size_t size) {
+    void *q = realloc(p, size);
+    if (q == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return q;
+}
+
+static void cls_set(RxClass *c, int b) {
+    c->bits[b >> 5] |= 1u << (b & 31);
+}
+
+static int cls_has(const RxClass *c, int b) {
+    return (c->bits[b >> 5] >> (b & 31)) & 1;
+}
+
+static void cls_range(RxClass *c, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) cls_set(c, b);
+}
+
+static void cls_invert(RxClass *c) {
+    for (int i = 0; i < 8; i++) c->bits[i] = ~c->bits[i];
+}
+
+static void cls_fold(RxClass *c) {
+    for (int b = 'a'; b <= 'z'; b++) {
+        if (cls_has(c, b) || cls_has(c, b - 32)) {
+            cls_set(c, b);
+            cls_set(c, b - 32);
+        }
+    }
+}
+
+/* \d \w \s and their complements */
+static void cls_add_escape(RxClass *c, int e) {
+    RxClass set = {{0}};
+    switch (e | 32) {
+    case 'd':
+        cls_range(&set, '0', '9');
+        break;
+    case 'w':
+        cls_range(&set, '0', '9');
+        cls_range(&set, 'A', 'Z');
+        cls_range(&set, 'a', 'z');
+        cls_set(&set, '_');
+        break;
+    default:  /* 's' */
+        cls_set(&set, ' ');
+        cls_range(&set, '\t', '\r');
+        break;
+    }
+    if (e >= 'A' && e <= 'Z') cls_invert(&set);
+    for (int i = 0; i < 8; i++) c->bits[i] |= set.bits[i];
+}
+
+static int escape_byte(int e) {
+    switch (e) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    default: return (unsigned char)e;
+    }
+}
+
+static int is_class_escape(int e) {
+    return e && strchr("dDwWsS", e) != NULL;
+}
+
+static int new_node(RxParser *p, int type) {
+    if (p->nnodes == p->nodecap) {
+        p->nodecap = p->nodecap ? p->nodecap * 2 : 32;
+        p->nodes = rx_realloc(p->nodes, sizeof(RxNode) * (size_t)p->nodecap);
+    }
+    RxNode *n = &p->nodes[p->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->a = n->b = -1;
+    return p->nnodes++;
+}
+
+/* A class node for 'c', case folded if the pattern ignores case */
+static int class_node(RxParser *p, RxClass c) {
+    if (p->icase) cls_fold(&c);
+    if (p->nclasses == p->classcap) {
+        p->classcap = p->classcap ? p->classcap * 2 : 16;
+        p->classes = rx_realloc(p->classes,
+                                sizeof(RxClass) * (size_t)p->classcap);
+    }
+    p->classes[p->nclasses] = c;
+    int n = new_node(p, N_CLASS);
+    p->nodes[n].cls = p->nclasses++;
+    return n;
+}
+
+static int pair_node(RxParser *p, int type, int a, int b) {
+    int n = new_node(p, type);
+    p->nodes[n].a = a;
+    p->nodes[n].b = b;
+    return n;
+}
+
+static int parse_alt(RxParser *p);
+
+static int fail(RxParser *p, const char *error) {
+    if (!p->error) p->error = error;
+    return -1;
+}
+
+static int parse_class(RxParser *p) {
+    RxClass c = {{0}};
+    int negate = 0;
+
+    p->p++;  /* '[' */
+    if (*p->p == '^') {
+        negate = 1;
+        p->p++;
+    }
+    for (int first = 1; *p->p && (*p->p != ']' || first); first = 0) {
+        int lo, hi;
+        if (*p->p == '\\') {
+            int e = *++p->p;
+            if (!e) break;
+            p->p++;
+            if (is_class_escape(e)) {
+                cls_add_escape(&c, e);
+                continue;
+            }
+            lo = escape_byte(e);
+        } else {
+            lo = (unsigned char)*p->p++;
+        }
+        hi = lo;
+        if (p->p[0] == '-' && p->p[1] && p->p[1] != ']') {
+            p->p++;
+            if (*p->p == '\\' && p->p[1]) {
+                p->p++;
+                hi = escape_byte(*p->p++);
+            } else {
+                hi = (unsigned char)*p->p++;
+            }
+            if (hi < lo) return fail(p, "Invalid range in []");
+        }
+        cls_range(&c, lo, hi);
+    }
+    if (*p->p != ']') return fail(p, "Missing ]");
+    p->p++;
+
+    /* Fold before inverting, so [^a] excludes A too */
+    if (p->icase) cls_fold(&c);
+    if (negate) cls_invert(&c);
+    return class_node(p, c);
+}
+
+static int parse_atom(RxParser *p) {
+    RxClass c = {{0}};
+    int e, n;
+
+    switch (*p->p) {
+    case '(':
+        p->p++;
+        if (p->p[0] == '?' && p->p[1] == ':') p->p += 2;
+        if (++p->depth > RX_MAX_DEPTH) return fail(p, "Groups nest too deeply");
+        n = parse_alt(p);
+        if (n < 0) return -1;
+        if (*p->p != ')') return fail(p, "Missing )");
+        p->p++;
+        p->depth--;
+        return n;
+    case '[':
+        return parse_class(p);
+    case '.':
+        p->p++;
+        cls_invert(&c);
+        return class_node(p, c);
+    case '^':
+        p->p++;
+        return new_node(p, N_BOL);
+    case '$':
+        p->p++;
+        return new_node(p, N_EOL);
+    case '*': case '+': case '?': case '{':
+        return fail(p, "Nothing to repeat");
+    case '\\':
+        e = *++p->p;
+        if (!e) return fail(p, "Trailing \\");
+        p->p++;
+        if (is_class_escape(e)) cls_add_escape(&c, e);
+        else cls_set(&c, escape_byte(e));
+        return class_node(p, c);
+    default:
+        cls_set(&c, (unsigned char)*p->p++);
+        return class_node(p, c);
+    }
+}
+
+static int parse_count(RxParser *p, int *value) {
+    if (*p->p < '0' || *p->p > '9') return 0;
+    long v = 0;
+    while (*p->p >= '0' && *p->p <= '9') {
+        if (v <= RX_MAX_REPEAT) v = v * 10 + (*p->p - '0');
+        p->p++;
+    }
+    *value = (int)(v > RX_MAX_REPEAT ? RX_MAX_REPEAT + 1 : v);
+    return 1;
+}
+
+static int parse_repeat(RxParser *p) {
+    int n = parse_atom(p);
+
+    while (n >= 0) {
+        int min, max;
+        switch (*p->p) {
+        case '*': min = 0; max = -1; p->p++; break;
+        case '+': min = 1; max = -1; p->p++; break;
+        case '?': min = 0; max = 1; p->p++; break;
+        case '{':
+            p->p++;
+            if (!parse_count(p, &min)) return fail(p, "Invalid {m,n}");
+            max = min;
+            if (*p->p == ',') {
+                p->p++;
+                if (!parse_count(p, &max)) max = -1;
+            }
+            if (*p->p != '}') return fail(p, "Invalid {m,n}");
+            p->p++;
+            if (min > RX_MAX_REPEAT || max > RX_MAX_REPEAT)
+                return fail(p, "Repeat count too large");
+            if (max >= 0 && max < min) return fail(p, "Invalid {m,n}");
+            break;
+        default:
+            return n;
+        }
+        int r = new_node(p, N_REPEAT);
+        p->nodes[r].a = n;
+        p->nodes[r].min = min;
+        p->nodes[r].max = max;
+        p->nodes[r].greedy = 1;
+        if (*p->p == '?') {
+            p->nodes[r].greedy = 0;
+            p->p++;
+        }
+        n = r;
+    }
+    return n;
+}
+
+/* A sequence, as a right-leaning chain of N_CAT nodes */
+static int parse_cat(RxParser *p) {
+    int head = -1, tail = -1;   /* tail: the last N_CAT of the chain */
+
+    while (*p->p && *p->p != '|' && *p->p != ')') {
+        int n = parse_repeat(p);
+        if (n < 0) return -1;
+        if (head < 0) {
+            head = n;
+        } else if (tail < 0) {
+            head = tail = pair_node(p, N_CAT, head, n);
+        } else {
+            int cat = pair_node(p, N_CAT, p->nodes[tail].b, n);
+            p->nodes[tail].b = cat;
+            tail = cat;
+        }
+    }
+    return head >= 0 ? head : new_node(p, N_EMPTY);
+}
+
+static int parse_alt(RxParser *p) {
+    int n = parse_cat(p);
+
+    while (n >= 0 && *p->p == '|') {
+        p->p++;
+        int b = parse_cat(p);
+        if (b < 0) return -1;
+        n = pair_node(p, N_ALT, n, b);
+    }
+    return n;
+}
+
+/* ======================= Programs ========================================== */
+
+enum { I_BYTE, I_SPLIT, I_JMP, I_MATCH, I_BOL, I_EOL };
+
+typedef struct RxInst {
+    int op;
+    int x, y;                 /* I_BYTE: class. I_SPLIT: preferred, other
+                                 branch. I_JMP: target */
+} RxInst;
+
+typedef struct RxCompiler {
+    const RxNode *nodes;
+    int reverse;              /* Emit the program for backward runs */
+    RxInst *inst;
+    int n, cap;
+    const char *error;
+} RxCompiler;
+
+static int emit_inst(RxCompiler *c, int op, int x, int y) {
+    if (c->error) return -1;
+    if (c->n >= RX_MAX_INSTS) {
+        c->error = "Pattern too large";
+        return -1;
+    }
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->inst = rx_realloc(c->inst, sizeof(RxInst) * (size_t)c->cap);
+    }
+    c->inst[c->n].op = op;
+    c->inst[c->n].x = x;
+    c->inst[c->n].y = y;
+    return c->n++;
+}
+
+static void emit(RxCompiler *c, int node);
+
+static void emit_cat(RxCompiler *c, int node) {
+    int len = 0;
+    for (int n = node; c->nodes[n].type == N_CAT; n = c->nodes[n].b) len++;
+
+    int *parts = rx_realloc(NULL, sizeof(int) * (size_t)(len + 1));
+    int k = 0, n = node;
+    for (; c->nodes[n].type == N_CAT; n = c->nodes[n].b)
+        parts[k++] = c->nodes[n].a;
+    parts[k] = n;
+
+    for (int i = 0; i <= len; i++)
+        emit(c, parts[c->reverse ? len - i : i]);
+    free(parts);
+}
+
+static void emit_repeat(RxCompiler *c, const RxNode *node) {
+    for (int i = 0; i < node->min; i++) emit(c, node->a);
+
+    if (node->max < 0) {
+        int split = emit_inst(c, I_SPLIT, 0, 0);
+        emit(c, node->a);
+        emit_inst(c, I_JMP, split, 0);
+        if (c->error) return;
+        c->inst[split].x = split + 1;
+        c->inst[split].y = c->n;
+        if (!node->greedy) {
+            /* Prefer leaving the loop */
+            c->inst[split].x = c->n;
+            c->inst[split].y = split + 1;
+        }
+    } else {
+        /* Each optional copy can skip to the end; chained through y */
+        int chain = -1;
+        for (int i = node->min; i < node->max; i++) {
+            int split = emit_inst(c, I_SPLIT, 0, chain);
+            if (split < 0) return;
+            c->inst[split].x = split + 1;
+            chain = split;
+            emit(c, node->a);
+        }
+        if (c->error) return;
+        while (chain >= 0) {
+            int next = c->inst[chain].y;
+            c->inst[chain].y = c->n;
+            if (!node->greedy) {
+                c->inst[chain].y = c->inst[chain].x;
+                c->inst[chain].x = c->n;
+            }
+            chain = next;
+        }
+    }
+}
+
+static void emit(RxCompiler *c, int node) {
+    const RxNode *n = &c->nodes[node];
+    int split, jmp;
+
+    if (c->error) return;
+    switch (n->type) {
+    case N_EMPTY:
+        break;
+    case N_CLASS:
+        emit_inst(c, I_BYTE, n->cls, 0);
+        break;
+    case N_BOL:
+        emit_inst(c, c->reverse ? I_EOL : I_BOL, 0, 0);
+        break;
+    case N_EOL:
+        emit_inst(c, c->reverse ? I_BOL : I_EOL, 0, 0);
+        break;
+    case N_CAT:
+        emit_cat(c, node);
+        break;
+    case N_ALT:
+        split = emit_inst(c, I_SPLIT, 0, 0);
+        emit(c, n->a);
+        jmp = emit_inst(c, I_JMP, 0, 0);
+        if (c->error) return;
+        c->inst[split].x = split + 1;
+        c->inst[split].y = c->n;
+        emit(c, n->b);
+        if (c->error) return;
+        c->inst[jmp].x = c->n;
+        break;
+    case N_REPEAT:
+        emit_repeat(c, n);
+        break;
+    }
+}
+
+/* ======================= Lazy DFA ========================================== */
+
+#define RX_ST_MATCH   1       /* A thread reached MATCH entering the state */
+#define RX_ST_RESTART 2       /* Threads still start at every byte */
+
+typedef struct RxState {
+    int *pcs;                 /* Threads (I_BYTE and I_EOL pcs), by priority */
+    int n;
+    int flags;                /* RX_ST_* */
+    int end_match;            /* A match at the end of the text, -1: unknown */
+    unsigned int hash;
+    int next[256];            /* State after each byte, -1: not built */
+} RxState;
+
+typedef struct RxDfa {
+    RxInst *inst;
+    int ninst;
+    const RxClass *classes;
+    int longest;              /* Keep every thread; no restarts */
+    RxState *states;
+    int nstates, statecap;
+    unsigned long epoch;      /* Bumped when the states are dropped */
+    int slots[RX_STATE_SLOTS];  /* State index + 1, 0: empty */
+    int start[2];             /* Start states, by the start assertion */
+    /* Scratch for building a state */
+    int *list;
+    int nlist;
+    int *stack;
+    unsigned int *mark;
+    unsigned int markgen;
+} RxDfa;
+
+static void dfa_flush(RxDfa *d) {
+    for (int i = 0; i < d->nstates; i++) free(d->states[i].pcs);
+    d->nstates = 0;
+    memset(d->slots, 0, sizeof(d->slots));
+    d->start[0] = d->start[1] = -1;
+    d->epoch++;
+}
+
+static void dfa_free(RxDfa *d) {
+    dfa_flush(d);
+    free(d->states);
+    free(d->inst);
+    free(d->list);
+    free(d->stack);
+    free(d->mark);
+}
+
+static void begin_list(RxDfa *d) {
+    d->nlist = 0;
+    if (++d->markgen == 0) {
+        memset(d->mark, 0, sizeof(unsigned int) * (size_t)d->ninst);
+        d->markgen = 1;
+    }
+}
+
+/* Append the threads reachable from 'pc' without consuming a byte. Returns
+ * 1 when MATCH is reached in leftmost-first order, where the threads of
+ * lower priority are then dropped. */
+static int closure(RxDfa *d, int pc, int at_start, int at_end, int *matched) {
+    int sp = 0;
+    d->stack[sp++] = pc;
+
+    while (sp > 0) {
+        int i = d->stack[--sp];
+        if (d->mark[i] == d->markgen) continue;
+        d->mark[i] = d->markgen;
+
+        const RxInst *in = &d->inst[i];
+        switch (in->op) {
+        case I_BYTE:
+            d->list[d->nlist++] = i;
+            break;
+        case I_EOL:
+            if (at_end) d->stack[sp++] = i + 1;
+            else d->list[d->nlist++] = i;
+            break;
+        case I_BOL:
+            if (at_start) d->stack[sp++] = i + 1;
+            break;
+        case I_JMP:
+            d->stack[sp++] = in->x;
+            break;
+        case I_SPLIT:
+            d->stack[sp++] = in->y;
+            d->stack[sp++] = in->x;
+            break;
+        case I_MATCH:
+            *matched = 1;
+            if (!d->longest) return 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* The state for the list just built */
+static int intern(RxDfa *d, int flags) {
+    unsigned int h = 2166136261u;     /* FNV-1a */
+    for (int i = 0; i < d->nlist; i++) {
+        h ^= (unsigned int)d->list[i];
+        h *= 16777619u;
+    }
+    h ^= (unsigned int)flags;
+    h *= 16777619u;
+
+    unsigned int k = h & (RX_STATE_SLOTS - 1);
+    while (d->slots[k]) {
+        RxState *s = &d->states[d->slots[k] - 1];
+        if (s->hash == h && s->n == d->nlist && s->flags == flags &&
+            memcmp(s->pcs, d->list, sizeof(int) * (size_t)d->nlist) == 0)
+            return d->slots[k] - 1;
+        k = (k + 1) & (RX_STATE_SLOTS - 1);
+    }
+
+    if (d->nstates >= RX_MAX_STATES) {
+        dfa_flush(d);
+        k = h & (RX_STATE_SLOTS - 1);
+    }
+    if (d->nstates == d->statecap) {
+        d->statecap = d->statecap ? d->statecap * 2 : 16;
+        d->states = rx_realloc(d->states,
+                               sizeof(RxState) * (size_t)d->statecap);
+    }
+    RxState *s = &d->states[d->nstates];
+    s->n = d->nlist;
+    s->pcs = rx_realloc(NULL, sizeof(int) * (size_t)(d->nlist ? d->nlist : 1));
+    memcpy(s->pcs, d->list, sizeof(int) * (size_t)d->nlist);
+    s->flags = flags;
+    s->end_match = -1;
+    s->hash = h;
+    for (int b = 0; b < 256; b++) s->next[b] = -1;
+    d->slots[k] = d->nstates + 1;
+    return d->nstates++;
+}
+
+static int dfa_start(RxDfa *d, int at_start) {
+    if (d->start[at_start] >= 0) return d->start[at_start];
+
+    int matched = 0;
+    begin_list(d);
+    closure(d, 0, at_start, 0, &matched);
+    int flags = matched ? RX_ST_MATCH : 0;
+    if (!d->longest && !matched) flags |= RX_ST_RESTART;
+    int s = intern(d, flags);
+    d->start[at_start] = s;
+    return s;
+}
+
+static int dfa_next(RxDfa *d, int s, unsigned char b) {
+    int t = d->states[s].next[b];
+    if (t >= 0) return t;
+
+    const RxState *st = &d->states[s];
+    int matched = 0;
+    begin_list(d);
+    for (int k = 0; k < st->n; k++) {
+        const RxInst *in = &d->inst[st->pcs[k]];
+        if (in->op != I_BYTE || !cls_has(&d->classes[in->x], b)) continue;
+        if (closure(d, st->pcs[k] + 1, 0, 0, &matched)) break;
+    }
+    int flags = matched ? RX_ST_MATCH : 0;
+    if ((st->flags & RX_ST_RESTART) && !matched) {
+        closure(d, 0, 0, 0, &matched);
+        flags = matched ? RX_ST_MATCH : RX_ST_RESTART;
+    }
+
+    unsigned long epoch = d->epoch;
+    t = intern(d, flags);
+    if (d->epoch == epoch) d->states[s].next[b] = t;
+    return t;
+}
+
+/* Whether a match ends at the end of the text in state 's' */
+static int dfa_end_match(RxDfa *d, int s) {
+    RxState *st = &d->states[s];
+    if (st->end_match < 0) {
+        int matched = 0;
+        begin_list(d);
+        for (int k = 0; k < st->n && !matched; k++) {
+            if (d->inst[st->pcs[k]].op == I_EOL)
+                closure(d, st->pcs[k] + 1, 0, 1, &matched);
+        }
+        st->end_match = matched;
+    }
+    return st->end_match;
+}
+
+static int compile_dfa(RxDfa *d, const RxParser *p, int root, int reverse,
+                       const RxClass *classes, const char **error) {
+    RxCompiler c;
+    memset(&c, 0, sizeof(c));
+    c.nodes = p->nodes;
+    c.reverse = reverse;
+    emit(&c, root);
+    emit_inst(&c, I_MATCH, 0, 0);
+    if (c.error) {
+        free(c.inst);
+        *error = c.error;
+        return -1;
+    }
+
+    memset(d, 0, sizeof(*d));
+    d->inst = c.inst;
+    d->ninst = c.n;
+    d->classes = classes;
+    d->longest = reverse;
+    d->start[0] = d->start[1] = -1;
+    d->list = rx_realloc(NULL, sizeof(int) * (size_t)c.n);
+    d->stack = rx_realloc(NULL, sizeof(int) * (size_t)(2 * c.n + 2));
+    d->mark = calloc((size_t)c.n, sizeof(unsigned int));
+    if (d->mark == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return 0;
+}
+
+/* ======================= Public API ======================================== */
+
+struct Regexp {
+    RxClass *classes;
+    RxDfa fwd, rev;
+    char prefix[RX_PREFIX_MAX];   /* Bytes every match starts with */
+    int prefix_len;
+    SearchPattern prefix_pat;
+    char required[RX_PREFIX_MAX]; /* Bytes every match contains */
+    int required_len;
+};
+
+static int single_byte(const RxClass *c) {
+    int b = -1;
+    for (int i = 0; i < 256; i++) {
+        if (!cls_has(c, i)) continue;
+        if (b >= 0) return -1;
+        b = i;
+    }
+    return b;
+}
+
+/* A byte class that is one byte, or one ASCII letter in either case:
+ * the byte (in lower case for a letter), else -1 */
+static int folded_byte(const RxClass *c) {
+    int b = single_byte(c);
+    if (b >= 0) return b;
+    for (int l = 'a'; l <= 'z'; l++) {
+        if (!cls_has(c, l) || !cls_has(c, l - 32)) continue;
+        RxClass pair = {{0}};
+        cls_set(&pair, l);
+        cls_set(&pair, l - 32);
+        return memcmp(c, &pair, sizeof(pair)) == 0 ? l : -1;
+    }
+    return -1;
+}
+
+/* Literal bytes at the start of every match of 'node' (letters folded
+ * when ignoring case). *whole is set when they are all 'node' matches. */
+static int literal_prefix(const RxParser *p, int node, char *buf, int cap,
+                          int *whole) {
+    const RxNode *n = &p->nodes[node];
+    int b, len, rest;
+
+    *whole = 0;
+    if (cap <= 0) return 0;
+    switch (n->type) {
+    case N_EMPTY:
+        *whole = 1;
+        return 0;
+    case N_CLASS:
+        b = p->icase ? folded_byte(&p->classes[n->cls])
+                     : single_byte(&p->classes[n->cls]);
+        if (b < 0) return 0;
+        buf[0] = (char)b;
+        *whole = 1;
+        return 1;
+    case N_CAT:
+        len = literal_prefix(p, n->a, buf, cap, whole);
+        if (!*whole) return len;
+        rest = literal_prefix(p, n->b, buf + len, cap - len, whole);
+        return len + rest;
+    default:
+        return 0;
+    }
+}
+
+/* What every match of a node holds, as byte strings (letters folded by
+ * folded_byte()): it starts with pre, ends with suf and contains best.
+ * When 'whole' is set every match is exactly pre (== suf). */
+typedef struct RxMust {
+    char pre[RX_PREFIX_MAX], suf[RX_PREFIX_MAX], best[RX_PREFIX_MAX];
+    int npre, nsuf, nbest;
+    int whole;
+} RxMust;
+
+/* dst = a followed by b, keeping the start (or the end if 'tail') */
+static int must_join(char *dst, const char *a, int na, const char *b, int nb,
+                     int tail) {
+    char tmp[2 * RX_PREFIX_MAX];
+    memcpy(tmp, a, (size_t)na);
+    memcpy(tmp + na, b, (size_t)nb);
+    int n = na + nb;
+    int keep = n > RX_PREFIX_MAX ? RX_PREFIX_MAX : n;
+    memcpy(dst, tail ? tmp + n - keep : tmp, (size_t)keep);
+    return keep;
+}
+
+static void must_best(RxMust *m, const char *s, int n) {
+    if (n <= m->nbest) return;
+    memcpy(m->best, s, (size_t)n);
+    m->nbest = n;
+}
+
+/* m = m followed by b */
+static void must_cat(RxMust *m, const RxMust *b) {
+    RxMust a = *m;
+
+    if (a.whole && b->whole && a.npre + b->npre <= RX_PREFIX_MAX) {
+        m->npre = must_join(m->pre, a.pre, a.npre, b->pre, b->npre, 0);
+        memcpy(m->suf, m->pre, (size_t)m->npre);
+        memcpy(m->best, m->pre, (size_t)m->npre);
+        m->nsuf = m->nbest = m->npre;
+        return;
+    }
+    m->whole = 0;
+    if (a.whole) m->npre = must_join(m->pre, a.pre, a.npre, b->pre, b->npre, 0);
+    m->nsuf = b->whole ? must_join(m->suf, a.suf, a.nsuf, b->suf, b->nsuf, 1)
+                       : must_join(m->suf, b->suf, b->nsuf, "", 0, 1);
+    must_best(m, b->best, b->nbest);
+    must_best(m, m->pre, m->npre);
+    must_best(m, m->suf, m->nsuf);
+
+    /* Across the join: the end of a, then the start of b */
+    char mid[RX_PREFIX_MAX];
+    int nmid = must_join(mid, a.suf, a.nsuf, b->pre, b->npre, 0);
+    must_best(m, mid, nmid);
+}
+
+/* Sequences are followed along their chain of N_CAT nodes rather than
+ * recursed into, so only groups nest calls. */
+static void required_bytes(const RxParser *p, int node, RxMust *m) {
+    const RxNode *n = &p->nodes[node];
+    RxMust b;
+    int c;
+
+    memset(m, 0, sizeof(*m));
+    switch (n->type) {
+    case N_EMPTY:
+    case N_BOL:
+    case N_EOL:
+        m->whole = 1;
+        break;
+    case N_CLASS:
+        c = folded_byte(&p->classes[n->cls]);
+        if (c < 0) break;
+        m->pre[0] = m->suf[0] = m->best[0] = (char)c;
+        m->npre = m->nsuf = m->nbest = 1;
+        m->whole = 1;
+        break;
+    case N_CAT:
+        required_bytes(p, n->a, m);
+        while (p->nodes[n->b].type == N_CAT) {
+            n = &p->nodes[n->b];
+            required_bytes(p, n->a, &b);
+            must_cat(m, &b);
+        }
+        required_bytes(p, n->b, &b);
+        must_cat(m, &b);
+        break;
+    case N_REPEAT: {
+        /* At least one copy: every match starts and ends like one */
+        int once = 1;
+        while (n->type == N_REPEAT && n->min >= 1) {
+            if (n->min != 1 || n->max != 1) once = 0;
+            n = &p->nodes[n->a];
+        }
+        if (n->type == N_REPEAT) break;
+        required_bytes(p, (int)(n - p->nodes), m);
+        if (!once) m->whole = 0;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+Regexp *regexp_compile(const char *pattern, int flags, const char **error) {
+    RxParser p;
+    memset(&p, 0, sizeof(p));
+    p.p = pattern;
+    p.icase = (flags & REGEXP_ICASE) != 0;
+
+    const char *err = NULL;
+    int root = parse_alt(&p);
+    if (root >= 0 && *p.p) fail(&p, "Unmatched )");
+    if (p.error) err = p.error;
+
+    Regexp *re = NULL;
+    if (!err) {
+        re = calloc(1, sizeof(Regexp));
+        if (re == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if (compile_dfa(&re->fwd, &p, root, 0, p.classes, &err) != 0) {
+            free(re);
+            re = NULL;
+        } else if (compile_dfa(&re->rev, &p, root, 1, p.classes, &err) != 0) {
+            dfa_free(&re->fwd);
+            free(re);
+            re = NULL;
+        } else {
+            int whole;
+            re->prefix_len = literal_prefix(&p, root, re->prefix,
+                                            RX_PREFIX_MAX, &whole);
+            search_pattern_init_icase(&re->prefix_pat, re->prefix,
+                                      re->prefix_len, p.icase);
+            RxMust must;
+            required_bytes(&p, root, &must);
+            memcpy(re->required, must.best, (size_t)must.nbest);
+            re->required_len = must.nbest;
+            re->classes = p.classes;
+            p.classes = NULL;
+        }
+    }
+
+    free(p.nodes);
+    free(p.classes);
+    if (error) *error = err;
+    return re;
+}
+
+void regexp_free(Regexp *re) {
+    if (!re) return;
+    dfa_free(&re->fwd);
+    dfa_free(&re->rev);
+    free(re->classes);
+    free(re);
+}
+
+int regexp_required(const Regexp *re, const char **bytes) {
+    *bytes = re->required;
+    return re->required_len;
+}
+
+int regexp_search(Regexp *re, const char *text, int len, int from,
+                  int *start, int *end) {
+    if (from < 0) from = 0;
+    if (from > len) return 0;
+
+    /* No match starts before the first occurrence of the prefix */
+    int pos = from;
+    if (re->prefix_len > 0) {
+        const char *p = search_pattern_find(&re->prefix_pat, text + from,
+                                            (size_t)(len - from));
+        if (!p) return 0;
+        pos = (int)(p - text);
+    }
+
+    /* Forward: where the leftmost-first match ends */
+    RxDfa *d = &re->fwd;
+    int s = dfa_start(d, pos == 0);
+    int e = (d->states[s].flags & RX_ST_MATCH) ? pos : -1;
+    int i = pos;
+    while (i < len && d->states[s].n > 0) {
+        s = dfa_next(d, s, (unsigned char)text[i++]);
+        if (d->states[s].flags & RX_ST_MATCH) e = i;
+    }
+    if (i == len && d->states[s].n > 0 && dfa_end_match(d, s)) e = len;
+    if (e < 0) return 0;
+
+    /* Backward from there: where it starts */
+    d = &re->rev;
+    s = dfa_start(d, e == len);
+    int b = (d->states[s].flags & RX_ST_MATCH) ? e : -1;
+    i = e;
+    while (i > pos && d->states[s].n > 0) {
+        s = dfa_next(d, s, (unsigned char)text[--i]);
+        if (d->states[s].flags & RX_ST_MATCH) b = i;
+    }
+    if (i == 0 && d->states[s].n > 0 && dfa_end_match(d, s)) b = 0;
+    if (b < 0) return 0;
+
+    *start = b;
+    *end = e;
+    return 1;
+}
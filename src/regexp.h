@@ -0,0 +1,46 @@
+/* regexp.h - Regular expressions matched in linear time
+ *
+ * Used by incremental search (Ctrl-R switches the prompt to regex), by
+ * :s and by loki.search(). Patterns are compiled once into an NFA program
+ * and matched by a DFA whose states are built on demand, so matching is
+ * linear in the text whatever the pattern: there is no backtracking.
+ *
+ * Syntax (bytes, not UTF-8 characters):
+ *
+ *   .            any byte
+ *   [abc] [^a-z] byte classes; \d \w \s and \D \W \S inside or outside
+ *   ^ $          start and end of the row
+ *   * + ? {m,n}  repetition, greedy; add ? for the shortest
+ *   a|b (a) (?:a) alternation and grouping (groups do not capture)
+ *   \t \n \r     and \ before any other byte for the byte itself
+ *
+ * A match is the leftmost one, and among those the one Perl would pick.
+ */
+
+#ifndef LOKI_REGEXP_H
+#define LOKI_REGEXP_H
+
+/* regexp_compile() flags */
+#define REGEXP_ICASE 1          /* ASCII letters match either case */
+
+typedef struct Regexp Regexp;
+
+/* Compile 'pattern'. Returns NULL and sets *error (a static string) if it
+ * is not valid. */
+Regexp *regexp_compile(const char *pattern, int flags, const char **error);
+
+void regexp_free(Regexp *re);
+
+/* Find the first match in the 'len' bytes at 'text' that starts at 'from'
+ * or later. Returns 1 and sets [*start, *end), or 0. ^ only matches at
+ * offset 0 and $ at 'len'. The DFA built so far is kept in 're' for the
+ * next search. */
+int regexp_search(Regexp *re, const char *text, int len, int from,
+                  int *start, int *end);
+
+/* Bytes that every match contains, for skipping text that lacks them (see
+ * search_index.h): sets *bytes and returns how many, 0 if none are known.
+ * ASCII letters matched in either case are given in lower case. */
+int regexp_required(const Regexp *re, const char **bytes);
+
+#endif /* LOKI_REGEXP_H */
@@ -0,0 +1,356 @@
+/* reload.c - Noticing a file changed on disk, and patching it in
+ *
+ * See reload.h for an overview. A file is taken to have changed when its
+ * size, modification time or inode differ from those noted when it was
+ * last read or written; the inode changes with every save that writes a
+ * new file and renames it over the old one, which also ends the watch, so
+ * the watch is started again on the new file.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <uv.h>
+
+#include "reload.h"
+#include "diff.h"
+#include "event_loop.h"
+#include "loader.h"
+#include "multicursor.h"
+#include "terminal.h"
+#include "undo.h"
+
+struct FileWatch {
+    uv_fs_event_t event;    /* Its data is the FileWatch */
+    int handle;             /* 'event' is initialized */
+    int watching;           /* 'event' is started: no polling */
+    int changed;            /* An event came since the last look */
+    uint64_t event_at;      /* When it came (uv_hrtime()) */
+    uint64_t checked;       /* When last looked at */
+    int known;              /* The fields below are noted */
+    off_t size;
+    int64_t mtime_sec, mtime_nsec;
+    dev_t dev;
+    ino_t ino;
+    int told;               /* The status said to :reload this change */
+};
+
+static void on_event(uv_fs_event_t *handle, const char *name, int events,
+                     int status) {
+    (void)name;
+    (void)events;
+    (void)status;
+    FileWatch *fw = handle->data;
+    fw->changed = 1;
+    fw->event_at = uv_hrtime();
+}
+
+static void on_close(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Note what the file is now. Returns 1 if the inode is another one. */
+static int note_file(FileWatch *fw, const struct stat *st) {
+    int moved = fw->known && (st->st_dev != fw->dev || st->st_ino != fw->ino);
+    fw->size = st->st_size;
+    fw->mtime_sec = (int64_t)st->st_mtime;
+    fw->mtime_nsec = mtime_ns(st);
+    fw->dev = st->st_dev;
+    fw->ino = st->st_ino;
+    fw->known = 1;
+    fw->told = 0;
+    return moved;
+}
+
+static int same_file(const FileWatch *fw, const struct stat *st) {
+    return fw->known && st->st_size == fw->size &&
+           (int64_t)st->st_mtime == fw->mtime_sec &&
+           mtime_ns(st) == fw->mtime_nsec &&
+           st->st_dev == fw->dev && st->st_ino == fw->ino;
+}
+
+static void watch(FileWatch *fw, const char *path) {
+    if (fw->watching) uv_fs_event_stop(&fw->event);
+    fw->watching = fw->handle &&
+                   uv_fs_event_start(&fw->event, on_event, path, 0) == 0;
+    fw->changed = 0;
+}
+
+void reload_watch(editor_ctx_t *ctx) {
+    EditorModel *model = &ctx->model;
+    if (model->filename == NULL || model->lazy || model->follow) return;
+
+    struct stat st;
+    if (stat(model->filename, &st) == -1) return;
+
+    FileWatch *fw = model->watch;
+    if (fw == NULL) {
+        fw = calloc(1, sizeof(FileWatch));
+        if (fw == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        fw->handle = uv_fs_event_init(uv_default_loop(), &fw->event) == 0;
+        fw->event.data = fw;
+        model->watch = fw;
+        note_file(fw, &st);
+        watch(fw, model->filename);
+    } else if (note_file(fw, &st) || !fw->watching) {
+        watch(fw, model->filename);
+    }
+    fw->changed = 0;
+    fw->checked = uv_hrtime();
+}
+
+void reload_unwatch(EditorModel *model) {
+    FileWatch *fw = model->watch;
+    if (fw == NULL) return;
+    model->watch = NULL;
+    /* Freed once the loop has closed the handle */
+    if (fw->handle) uv_close((uv_handle_t *)&fw->event, on_close);
+    else free(fw);
+}
+
+/* Replace 'count' rows from 'first' by the 'len' bytes at 'lines', each
+ * line of them ended by '\n', as one edit. 'numrows' is the rows the
+ * buffer holds, 0 for a buffer of one empty row. */
+static void patch_rows(editor_ctx_t *ctx, int numrows, int first, int count,
+                       const char *lines, size_t len) {
+    int last = first + count - 1;
+    if (first + count < numrows) {
+        /* Rows below: replace up to the start of the next */
+        editor_replace_range(ctx, first, 0, first + count, 0, lines, len,
+                             NULL, NULL);
+    } else if (first > 0) {
+        /* At the end: the rows go with the newline before them */
+        const t_erow *prev = &ctx->model.row[first - 1];
+        int end_row = count > 0 ? last : first - 1;
+        int end_col = ctx->model.row[end_row].size;
+        struct abuf text = ABUF_INIT;
+        if (len > 0) {
+            terminal_buffer_append(&text, "\n", 1);
+            terminal_buffer_append(&text, lines, (int)len - 1);
+        }
+        editor_replace_range(ctx, first - 1, prev->size, end_row, end_col,
+                             text.b ? text.b : "", (size_t)text.len, NULL, NULL);
+        terminal_buffer_free(&text);
+    } else {
+        /* All of the buffer */
+        int end_row = count > 0 ? last : 0;
+        int end_col = ctx->model.numrows > 0 ? ctx->model.row[end_row].size : 0;
+        editor_replace_range(ctx, 0, 0, end_row, end_col,
+                             lines, len ? len - 1 : 0, NULL, NULL);
+    }
+}
+
+/* Append a hunk, joined to the last one if it starts where that ends */
+static void add_hunk(DiffHunk **hunks, int *n, int *cap, const DiffHunk *h) {
+    if (*n > 0) {
+        DiffHunk *last = &(*hunks)[*n - 1];
+        if (last->old_start + last->old_count == h->old_start &&
+            last->new_start + last->new_count == h->new_start) {
+            last->old_count += h->old_count;
+            last->new_count += h->new_count;
+            return;
+        }
+    }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        DiffHunk *grown = realloc(*hunks, sizeof(DiffHunk) * (size_t)*cap);
+        if (grown == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *hunks = grown;
+    }
+    (*hunks)[(*n)++] = *h;
+}
+
+/* diff_lines() takes rows with the same hash for the same: compare those
+ * it left alone, and make the ones that differ after all hunks of their
+ * own, so that none is kept with the wrong text */
+static void add_collisions(const EditorModel *model, int numrows, const char *data,
+                           const LineIndex *index, DiffHunk **hunks, int *nhunks) {
+    DiffHunk *out = NULL;
+    int nout = 0, cap = 0;
+    int o = 0, d = 0;
+    for (int i = 0; i <= *nhunks; i++) {
+        int end = i < *nhunks ? (*hunks)[i].old_start : numrows;
+        for (; o < end; o++, d++) {
+            const t_erow *r = &model->row[o];
+            if (r->size == index->len[d] &&
+                memcmp(r->chars, data + index->start[d], (size_t)r->size) == 0)
+                continue;
+            DiffHunk h = { o, 1, d, 1 };
+            add_hunk(&out, &nout, &cap, &h);
+        }
+        if (i == *nhunks) break;
+        add_hunk(&out, &nout, &cap, &(*hunks)[i]);
+        o += (*hunks)[i].old_count;
+        d += (*hunks)[i].new_count;
+    }
+    free(*hunks);
+    *hunks = out;
+    *nhunks = nout;
+}
+
+/* The row the cursor on row 'row' is on after the hunks */
+static int map_row(const DiffHunk *hunks, int nhunks, int row) {
+    int shift = 0;
+    for (int i = 0; i < nhunks; i++) {
+        const DiffHunk *h = &hunks[i];
+        if (row < h->old_start) break;
+        if (row < h->old_start + h->old_count) {
+            int at = row - h->old_start;
+            if (at >= h->new_count) at = h->new_count > 0 ? h->new_count - 1 : 0;
+            return h->new_start + at;
+        }
+        shift += h->new_count - h->old_count;
+    }
+    return row + shift;
+}
+
+int reload_from_disk(editor_ctx_t *ctx) {
+    EditorModel *model = &ctx->model;
+    if (model->filename == NULL) {
+        editor_set_status_msg(ctx, "No file to reload");
+        return -1;
+    }
+    if (editor_refuse_edit(ctx)) return -1;
+
+    LoadedFile file = {0};
+    LineIndex index = {0};
+    if (loader_open(model->filename, &file) == -1 ||
+        loader_index_lines(file.data, file.size, &index) == -1) {
+        editor_set_status_msg(ctx, "Cannot reload %s: %s", model->filename,
+                              strerror(errno));
+        loader_close(&file);
+        return -1;
+    }
+    if (index.binary) {
+        editor_set_status_msg(ctx, "Not reloaded: %s is binary now", model->filename);
+        loader_index_free(&index);
+        loader_close(&file);
+        return -1;
+    }
+
+    /* A buffer of one empty row is an empty file */
+    int numrows = model->numrows;
+    if (numrows == 1 && model->row[0].size == 0) numrows = 0;
+
+    uint64_t *old = malloc(sizeof(uint64_t) * ((size_t)numrows + 1));
+    uint64_t *disk = malloc(sizeof(uint64_t) * ((size_t)index.count + 1));
+    if (old == NULL || disk == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int i = 0; i < numrows; i++)
+        old[i] = diff_hash(model->row[i].chars, (size_t)model->row[i].size);
+    for (int i = 0; i < index.count; i++)
+        disk[i] = diff_hash(file.data + index.start[i], (size_t)index.len[i]);
+
+    DiffHunk *hunks;
+    int nhunks;
+    if (diff_lines(old, numrows, disk, index.count, &hunks, &nhunks) == -1) {
+        perror("Out of memory");
+        exit(1);
+    }
+    free(old);
+    free(disk);
+    add_collisions(model, numrows, file.data, &index, &hunks, &nhunks);
+
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+    int cy = ctx->view.cy;
+    int changed = 0;
+
+    /* From the bottom up, so the rows of the hunks above stay put */
+    undo_hold_group(ctx);
+    for (int i = nhunks - 1; i >= 0; i--) {
+        const DiffHunk *h = &hunks[i];
+        struct abuf text = ABUF_INIT;
+        for (int j = h->new_start; j < h->new_start + h->new_count; j++) {
+            terminal_buffer_append(&text, file.data + index.start[j], index.len[j]);
+            terminal_buffer_append(&text, "\n", 1);
+        }
+        patch_rows(ctx, numrows, h->old_start, h->old_count,
+                   text.b ? text.b : "", (size_t)text.len);
+        terminal_buffer_free(&text);
+        numrows += h->new_count - h->old_count;
+        changed += h->old_count > h->new_count ? h->old_count : h->new_count;
+    }
+    undo_release_group(ctx);
+
+    if (nhunks > 0) {
+        /* The cursor stays on its line, where it is on the screen */
+        row = map_row(hunks, nhunks, row);
+        if (row >= model->numrows) row = model->numrows - 1;
+        if (row < 0) row = 0;
+        if (model->numrows > 0 && col > model->row[row].size) col = model->row[row].size;
+        ctx->view.rowoff = row > cy ? row - cy : 0;
+        ctx->view.cy = row - ctx->view.rowoff;
+        editor_cursor_to(ctx, row, col);
+        ctx->view.sel_active = 0;
+        multicursor_clear(ctx);
+    }
+    free(hunks);
+    loader_index_free(&index);
+    loader_close(&file);
+
+    model->dirty = 0;
+    undo_history_saved(ctx);
+    reload_watch(ctx);
+    return changed;
+}
+
+int reload_tick(editor_ctx_t *ctx, uint64_t now) {
+    EditorModel *model = &ctx->model;
+    FileWatch *fw = model->watch;
+    if (fw == NULL || model->follow || model->lazy) return -1;
+
+    uint64_t settle = fw->event_at + (uint64_t)RELOAD_SETTLE_MS * 1000000;
+    uint64_t due = fw->checked + (uint64_t)RELOAD_POLL_MS * 1000000;
+    int polled = !fw->watching || !event_loop_active();
+    int look = (fw->changed && now >= settle) || (polled && now >= due);
+
+    /* A save in progress writes the file: look once it is done */
+    if (look && model->save_job == NULL) {
+        struct stat st;
+        fw->changed = 0;
+        fw->checked = now;
+        due = now + (uint64_t)RELOAD_POLL_MS * 1000000;
+        if (stat(model->filename, &st) == 0 && !same_file(fw, &st)) {
+            if (!model->dirty) {
+                int rows = reload_from_disk(ctx);
+                /* Not loadable (binary now): not again until it changes */
+                if (rows == -1 && model->watch) note_file(model->watch, &st);
+                if (rows > 0)
+                    editor_set_status_msg(ctx, "File changed on disk: %d line%s updated",
+                                          rows, rows == 1 ? "" : "s");
+            } else if (!fw->told) {
+                editor_set_status_msg(ctx, "File changed on disk: :reload to load it "
+                                      "(undo brings your changes back)");
+                fw->told = 1;
+            }
+        }
+    }
+
+    fw = model->watch;
+    if (fw == NULL) return -1;
+    if (fw->changed) {
+        settle = fw->event_at + (uint64_t)RELOAD_SETTLE_MS * 1000000;
+        return now >= settle ? 1 : (int)((settle - now) / 1000000) + 1;
+    }
+    if (!polled) return -1;
+    return now >= due ? 0 : (int)((due - now) / 1000000) + 1;
+}
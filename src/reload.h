@@ -0,0 +1,57 @@
+/* reload.h - Noticing a file changed on disk, and patching it in
+ *
+ * reload_watch() watches a buffer's file with a uv_fs_event_t once it is
+ * read or written, and notes what the file was then (size, time, inode).
+ * An event only sets a flag; reload_tick(), run by the main loop, waits
+ * for the writes to settle, and if the file is no longer what was noted:
+ *
+ *   - a buffer without unsaved changes is patched to it at once;
+ *   - one with changes is left alone, and the status says :reload loads
+ *     the file.
+ *
+ * reload_from_disk() patches rather than reloads. The rows and the file's
+ * lines are hashed (diff_hash()) and diffed (diff_lines()), and only the
+ * hunks that differ are replaced, each with one editor_replace_range()
+ * and all of them held in one undo group. The rows between keep their
+ * highlight, marks and folds, and undo goes back to the buffer as it was
+ * before the reload, unsaved changes included.
+ *
+ * Buffers that are followed (follow.h) or too large to load (lazy.h) are
+ * not watched this way. Without file events the file is checked every
+ * RELOAD_POLL_MS.
+ */
+
+#ifndef LOKI_RELOAD_H
+#define LOKI_RELOAD_H
+
+#include <stdint.h>
+#include "internal.h"
+
+/* Milliseconds the file has to stay quiet after an event before it is
+ * looked at: a formatter or checkout writes in several steps */
+#define RELOAD_SETTLE_MS 50
+
+/* Milliseconds between checks of a file without file events */
+#define RELOAD_POLL_MS 1000
+
+typedef struct FileWatch FileWatch;
+
+/* The buffer's file was just read or written: note what it is now, and
+ * watch it (again, if it was). Does nothing for a buffer with no file. */
+void reload_watch(editor_ctx_t *ctx);
+
+/* Stop watching. Safe on a model not watched. */
+void reload_unwatch(EditorModel *model);
+
+/* Patch the buffer to the file on disk, as one undo step. Returns the
+ * rows changed (0: the same already), or -1 with the reason in the
+ * status. */
+int reload_from_disk(editor_ctx_t *ctx);
+
+/* Look at the file if an event came and it has settled by 'now'
+ * (uv_hrtime()), or if a check is due. Returns the milliseconds until the
+ * next look is due, or -1 if there is nothing to do until the next
+ * event. */
+int reload_tick(editor_ctx_t *ctx, uint64_t now);
+
+#endif /* LOKI_RELOAD_H */
@@ -0,0 +1,517 @@
+/* remote.c - Files read over ssh or HTTP a block at a time
+ *
+ * See remote.h for an overview. The cache is an unlinked temporary file
+ * ftruncate()d to the size of the remote file, so blocks not fetched take
+ * no disk; fetched ones are written into it with pwrite() and read
+ * through a shared read-only mapping. A byte per block says whether it is
+ * present, set once its bytes are written, so readers check it without
+ * the lock; the lock is held by the one thread transferring at a time.
+ */
+
+#define _DEFAULT_SOURCE     /* mkstemp(), strdup() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifdef LOKI_ENABLE_HTTP
+#include <curl/curl.h>
+#endif
+
+#include "remote.h"
+
+extern char **environ;
+
+enum { REMOTE_SSH, REMOTE_HTTP };
+
+struct RemoteFile {
+    int scheme;
+    char *url;
+    char *host;             /* ssh: [user@]host */
+    char *port;             /* ssh: or NULL */
+    char *path;             /* ssh: the path on the host */
+    int fd;                 /* The cache */
+    size_t size;
+    size_t nblocks;
+    atomic_uchar *present;  /* A byte per block, set once it is fetched */
+    atomic_size_t prefix;   /* Blocks present from the first */
+    pthread_mutex_t lock;   /* Held while transferring */
+    char error[160];
+    unsigned long requests;
+    unsigned long long bytes;
+#ifdef LOKI_ENABLE_HTTP
+    CURL *easy;
+#endif
+};
+
+static const char *ssh_program = "ssh";
+
+void remote_set_ssh_program(const char *program) {
+    ssh_program = program ? program : "ssh";
+}
+
+int remote_is_url(const char *name) {
+    return strncmp(name, "ssh://", 6) == 0 || strncmp(name, "http://", 7) == 0 ||
+           strncmp(name, "https://", 8) == 0;
+}
+
+/* Where the bytes of a transfer go: 'buf' if set, else the cache from
+ * 'off'. More than 'want' is an error. */
+typedef struct Sink {
+    RemoteFile *rf;
+    char *buf;
+    size_t off, want, got;
+} Sink;
+
+static int sink_put(Sink *s, const char *p, size_t n) {
+    if (n > s->want - s->got) return -1;
+    if (s->buf) {
+        memcpy(s->buf + s->got, p, n);
+        s->got += n;
+        return 0;
+    }
+    while (n > 0) {
+        ssize_t w = pwrite(s->rf->fd, p, n, (off_t)(s->off + s->got));
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+        s->got += (size_t)w;
+    }
+    return 0;
+}
+
+/* ================================ ssh ================================== */
+
+/* Split ssh://[user@]host[:port]/path. Returns 0, or -1 if malformed. */
+static int ssh_parse(RemoteFile *rf, const char *url) {
+    const char *host = url + 6;
+    const char *slash = strchr(host, '/');
+    if (slash == NULL || slash == host || slash[1] == '\0') return -1;
+    const char *colon = memchr(host, ':', (size_t)(slash - host));
+    const char *end = colon ? colon : slash;
+
+    rf->host = strndup(host, (size_t)(end - host));
+    rf->port = colon ? strndup(colon + 1, (size_t)(slash - colon - 1)) : NULL;
+    /* ssh://host/~/log is relative to the home directory */
+    rf->path = strdup(strncmp(slash, "/~/", 3) == 0 ? slash + 3 : slash);
+    if (!rf->host || (colon && !rf->port) || !rf->path) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return 0;
+}
+
+/* "'path'", quoted for the host's shell */
+static char *shell_quote(const char *s) {
+    char *out = malloc(strlen(s) * 4 + 3), *o = out;
+    if (out == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *o++ = '\'';
+    for (; *s; s++) {
+        if (*s == '\'') {
+            memcpy(o, "'\\''", 4);
+            o += 4;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o++ = '\'';
+    *o = '\0';
+    return out;
+}
+
+/* Run 'command' on the host, its output into 'sink'. Returns 0 if it
+ * exited with status 0, else -1 with rf->error set. */
+static int ssh_run(RemoteFile *rf, const char *command, Sink *sink) {
+    char control[512], persist[32], timeout[32];
+    const char *dir = getenv("TMPDIR");
+    snprintf(control, sizeof(control), "ControlPath=%s/loki-ssh-%%C",
+             dir && dir[0] ? dir : "/tmp");
+    snprintf(persist, sizeof(persist), "ControlPersist=%d", REMOTE_CONTROL_PERSIST);
+    snprintf(timeout, sizeof(timeout), "ConnectTimeout=%d", REMOTE_CONNECT_TIMEOUT);
+
+    char *argv[20];
+    int argc = 0;
+    argv[argc++] = (char *)ssh_program;
+    argv[argc++] = "-o";
+    argv[argc++] = "BatchMode=yes";
+    argv[argc++] = "-o";
+    argv[argc++] = timeout;
+    argv[argc++] = "-o";
+    argv[argc++] = "ControlMaster=auto";
+    argv[argc++] = "-o";
+    argv[argc++] = control;
+    argv[argc++] = "-o";
+    argv[argc++] = persist;
+    if (rf->port) {
+        argv[argc++] = "-p";
+        argv[argc++] = rf->port;
+    }
+    argv[argc++] = "--";
+    argv[argc++] = rf->host;
+    argv[argc++] = (char *)command;
+    argv[argc] = NULL;
+
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        snprintf(rf->error, sizeof(rf->error), "%s", strerror(errno));
+        return -1;
+    }
+    /* Not to be inherited by children spawned meanwhile by other threads */
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+
+    /* The terminal is the editor's: ssh gets neither it nor its stderr */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, ssh_program, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+    if (rc != 0) {
+        close(pipefd[0]);
+        snprintf(rf->error, sizeof(rf->error), "cannot run %s: %s",
+                 ssh_program, strerror(rc));
+        return -1;
+    }
+
+    char buf[65536];
+    int overflow = 0;
+    ssize_t n;
+    while ((n = read(pipefd[0], buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (sink_put(sink, buf, (size_t)n) == -1) {
+            overflow = 1;
+            break;
+        }
+    }
+    close(pipefd[0]);   /* A command stopped early gets SIGPIPE */
+
+    int status = 0;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {
+    }
+    int exited = waited != -1 && WIFEXITED(status);
+    if (exited && WEXITSTATUS(status) == 255) {
+        snprintf(rf->error, sizeof(rf->error), "ssh cannot reach %s", rf->host);
+        return -1;
+    }
+    if (!exited || WEXITSTATUS(status) != 0 || overflow || n == -1) {
+        snprintf(rf->error, sizeof(rf->error), "cannot read %s on %s",
+                 rf->path, rf->host);
+        return -1;
+    }
+    return 0;
+}
+
+static int ssh_size(RemoteFile *rf, size_t *size) {
+    char *path = shell_quote(rf->path);
+    char *command = malloc(strlen(path) + 16);
+    if (command == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sprintf(command, "wc -c < %s", path);
+
+    char out[32];
+    Sink sink = {rf, out, 0, sizeof(out) - 1, 0};
+    int rc = ssh_run(rf, command, &sink);
+    free(command);
+    free(path);
+    if (rc == -1) return -1;
+
+    out[sink.got] = '\0';
+    char *end;
+    unsigned long long n = strtoull(out, &end, 10);
+    if (end == out) {
+        snprintf(rf->error, sizeof(rf->error), "no size for %s on %s",
+                 rf->path, rf->host);
+        return -1;
+    }
+    *size = (size_t)n;
+    return 0;
+}
+
+static int ssh_range(RemoteFile *rf, size_t off, size_t len) {
+    char *path = shell_quote(rf->path);
+    char *command = malloc(strlen(path) + 80);
+    if (command == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    /* tail seeks to the offset of a regular file, reading nothing before */
+    sprintf(command, "tail -c +%zu %s | head -c %zu", off + 1, path, len);
+    Sink sink = {rf, NULL, off, len, 0};
+    int rc = ssh_run(rf, command, &sink);
+    free(command);
+    free(path);
+    if (rc == 0 && sink.got != len) {
+        snprintf(rf->error, sizeof(rf->error), "%s on %s is shorter than it was",
+                 rf->path, rf->host);
+        return -1;
+    }
+    return rc;
+}
+
+/* ================================ HTTP ================================= */
+
+#ifdef LOKI_ENABLE_HTTP
+static size_t http_write(char *p, size_t size, size_t n, void *opaque) {
+    return sink_put(opaque, p, size * n) == 0 ? size * n : 0;
+}
+
+/* Reset the handle for a request of the URL. Returns 0, or -1 with
+ * rf->error set. */
+static int http_perform(RemoteFile *rf, Sink *sink, const char *range, long *code) {
+    curl_easy_reset(rf->easy);
+    curl_easy_setopt(rf->easy, CURLOPT_URL, rf->url);
+    curl_easy_setopt(rf->easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(rf->easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(rf->easy, CURLOPT_CONNECTTIMEOUT, (long)REMOTE_CONNECT_TIMEOUT);
+    curl_easy_setopt(rf->easy, CURLOPT_USERAGENT, "loki");
+    if (sink) {
+        curl_easy_setopt(rf->easy, CURLOPT_RANGE, range);
+        curl_easy_setopt(rf->easy, CURLOPT_WRITEFUNCTION, http_write);
+        curl_easy_setopt(rf->easy, CURLOPT_WRITEDATA, sink);
+    } else {
+        curl_easy_setopt(rf->easy, CURLOPT_NOBODY, 1L);
+    }
+    CURLcode res = curl_easy_perform(rf->easy);
+    *code = 0;
+    curl_easy_getinfo(rf->easy, CURLINFO_RESPONSE_CODE, code);
+    if (res == CURLE_WRITE_ERROR && *code == 200) {
+        snprintf(rf->error, sizeof(rf->error), "the server does not take range requests");
+        return -1;
+    }
+    if (res != CURLE_OK) {
+        snprintf(rf->error, sizeof(rf->error), "%s", curl_easy_strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+static int http_size(RemoteFile *rf, size_t *size) {
+    long code;
+    if (http_perform(rf, NULL, NULL, &code) == -1) return -1;
+    curl_off_t length = -1;
+    curl_easy_getinfo(rf->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (code != 200 || length < 0) {
+        snprintf(rf->error, sizeof(rf->error),
+                 code != 200 ? "HTTP status %ld" : "no Content-Length", code);
+        return -1;
+    }
+    *size = (size_t)length;
+    return 0;
+}
+
+static int http_range(RemoteFile *rf, size_t off, size_t len) {
+    char range[48];
+    snprintf(range, sizeof(range), "%zu-%zu", off, off + len - 1);
+    Sink sink = {rf, NULL, off, len, 0};
+    long code;
+    if (http_perform(rf, &sink, range, &code) == -1) return -1;
+    /* A whole file asked for may come whole */
+    int whole = code == 200 && off == 0 && len == rf->size;
+    if ((code != 206 && !whole) || sink.got != len) {
+        snprintf(rf->error, sizeof(rf->error),
+                 code == 206 || whole ? "the file is shorter than it was" :
+                 code == 200 ? "the server does not take range requests" :
+                 "HTTP status %ld", code);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* ============================== The cache ============================== */
+
+/* The unlinked, sparse cache file of 'size' bytes, mapped into 'file'.
+ * Returns its descriptor, or -1. */
+static int cache_create(size_t size, LoadedFile *file) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/loki-remote-XXXXXX", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+    unlink(path);
+    if (ftruncate(fd, (off_t)size) == -1) {
+        close(fd);
+        return -1;
+    }
+    memset(file, 0, sizeof(*file));
+    if (size == 0) return fd;
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    file->data = data;
+    file->size = size;
+    file->mapped = 1;
+    return fd;
+}
+
+RemoteFile *remote_open(const char *url, LoadedFile *file, char *err, size_t errlen) {
+    RemoteFile *rf = calloc(1, sizeof(RemoteFile));
+    if (rf == NULL || (rf->url = strdup(url)) == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    rf->fd = -1;
+    pthread_mutex_init(&rf->lock, NULL);
+
+    int rc;
+    if (strncmp(url, "ssh://", 6) == 0) {
+        rf->scheme = REMOTE_SSH;
+        if (ssh_parse(rf, url) == -1) {
+            snprintf(err, errlen, "Not an ssh://[user@]host[:port]/path URL: %s", url);
+            remote_close(rf);
+            return NULL;
+        }
+        rc = ssh_size(rf, &rf->size);
+    } else {
+        rf->scheme = REMOTE_HTTP;
+#ifdef LOKI_ENABLE_HTTP
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        rf->easy = curl_easy_init();
+        if (rf->easy == NULL) {
+            curl_global_cleanup();
+            snprintf(err, errlen, "Cannot open %s: no curl handle", url);
+            remote_close(rf);
+            return NULL;
+        }
+        rc = http_size(rf, &rf->size);
+#else
+        snprintf(err, errlen, "Cannot open %s: built without HTTP (LOKI_ENABLE_HTTP)", url);
+        remote_close(rf);
+        return NULL;
+#endif
+    }
+    if (rc == -1) {
+        snprintf(err, errlen, "Cannot open %s: %s", url, rf->error);
+        remote_close(rf);
+        return NULL;
+    }
+
+    rf->nblocks = (rf->size + REMOTE_BLOCK - 1) / REMOTE_BLOCK;
+    rf->present = calloc(rf->nblocks + 1, sizeof(atomic_uchar));
+    if (rf->present == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    atomic_init(&rf->prefix, 0);
+    rf->fd = cache_create(rf->size, file);
+    if (rf->fd == -1) {
+        snprintf(err, errlen, "Cannot open %s: no cache: %s", url, strerror(errno));
+        remote_close(rf);
+        return NULL;
+    }
+    return rf;
+}
+
+/* Fetch blocks [first, last] into the cache, and mark them present */
+static int fetch_run(RemoteFile *rf, size_t first, size_t last) {
+    size_t off = first * REMOTE_BLOCK;
+    size_t end = (last + 1) * REMOTE_BLOCK;
+    if (end > rf->size) end = rf->size;
+
+    int rc;
+#ifdef LOKI_ENABLE_HTTP
+    if (rf->scheme == REMOTE_HTTP) rc = http_range(rf, off, end - off);
+    else
+#endif
+    rc = ssh_range(rf, off, end - off);
+    if (rc == -1) return -1;
+
+    rf->requests++;
+    rf->bytes += end - off;
+    for (size_t b = first; b <= last; b++)
+        atomic_store_explicit(&rf->present[b], 1, memory_order_release);
+    size_t p = atomic_load_explicit(&rf->prefix, memory_order_relaxed);
+    while (p < rf->nblocks && atomic_load_explicit(&rf->present[p], memory_order_relaxed)) p++;
+    atomic_store_explicit(&rf->prefix, p, memory_order_release);
+    return 0;
+}
+
+int remote_fetch(RemoteFile *rf, size_t off, size_t len) {
+    if (off >= rf->size || len == 0) return 0;
+    if (len > rf->size - off) len = rf->size - off;
+    size_t first = off / REMOTE_BLOCK, last = (off + len - 1) / REMOTE_BLOCK;
+
+    /* Present already, as all but the first reads are */
+    size_t b = first;
+    while (b <= last && atomic_load_explicit(&rf->present[b], memory_order_acquire)) b++;
+    if (b > last) return 0;
+
+    /* A run of missing blocks a request */
+    int rc = 0;
+    size_t run_max = REMOTE_FETCH_MAX / REMOTE_BLOCK;
+    pthread_mutex_lock(&rf->lock);
+    for (; b <= last && rc == 0; b++) {
+        if (atomic_load_explicit(&rf->present[b], memory_order_acquire)) continue;
+        size_t e = b;
+        while (e < last && e + 1 - b < run_max &&
+               !atomic_load_explicit(&rf->present[e + 1], memory_order_relaxed))
+            e++;
+        rc = fetch_run(rf, b, e);
+        b = e;
+    }
+    pthread_mutex_unlock(&rf->lock);
+    return rc;
+}
+
+size_t remote_prefix(const RemoteFile *rf) {
+    size_t p = atomic_load_explicit(&rf->prefix, memory_order_acquire) * REMOTE_BLOCK;
+    return p < rf->size ? p : rf->size;
+}
+
+const char *remote_error(RemoteFile *rf) {
+    return rf->error;
+}
+
+void remote_stats(RemoteFile *rf, RemoteStats *out) {
+    pthread_mutex_lock(&rf->lock);
+    out->requests = rf->requests;
+    out->bytes = rf->bytes;
+    out->nblocks = rf->nblocks;
+    out->blocks = 0;
+    for (size_t b = 0; b < rf->nblocks; b++) out->blocks += atomic_load(&rf->present[b]);
+    pthread_mutex_unlock(&rf->lock);
+}
+
+void remote_close(RemoteFile *rf) {
+    if (rf == NULL) return;
+#ifdef LOKI_ENABLE_HTTP
+    if (rf->easy) {
+        curl_easy_cleanup(rf->easy);
+        curl_global_cleanup();
+    }
+#endif
+    if (rf->fd != -1) close(rf->fd);
+    pthread_mutex_destroy(&rf->lock);
+    free(rf->present);
+    free(rf->url);
+    free(rf->host);
+    free(rf->port);
+    free(rf->path);
+    free(rf);
+}
@@ -0,0 +1,75 @@
+/* remote.h - Files read over ssh or HTTP a block at a time
+ *
+ * editor_open() shows ssh://[user@]host[:port]/path and, when built with
+ * LOKI_ENABLE_HTTP, http:// and https:// URLs as it shows large files
+ * (see lazy.h), whatever their size. Only the size is asked for on open:
+ * the file is mapped from a local cache, a sparse temporary file of that
+ * size, and the REMOTE_BLOCK byte blocks of it the window or a search
+ * reads are fetched into it as they are first needed, a run of missing
+ * blocks a request. Opening a 10 GB log costs a request for its size and
+ * one for the blocks of its first lines.
+ *
+ * Over ssh a block run is read by "tail -c +N path | head -c M" on the
+ * host, the ssh connection shared through a control socket so only the
+ * first request pays for the handshake; ssh must be able to log in
+ * without asking for a password. Over HTTP it is a range request, which
+ * the server must answer with 206 Partial Content.
+ *
+ * The line index grows over the blocks present from the start of the
+ * file, so line numbers are known as far as the file has been read, and
+ * the rest is not fetched just to count lines.
+ */
+
+#ifndef LOKI_REMOTE_H
+#define LOKI_REMOTE_H
+
+#include <stddef.h>
+#include "loader.h"
+
+/* Bytes a block of the cache, and the most fetched by one request */
+#define REMOTE_BLOCK ((size_t)1 << 20)
+#define REMOTE_FETCH_MAX ((size_t)8 << 20)
+
+/* Seconds ssh waits to connect, and keeps a shared connection idle */
+#define REMOTE_CONNECT_TIMEOUT 10
+#define REMOTE_CONTROL_PERSIST 60
+
+typedef struct RemoteFile RemoteFile;
+
+typedef struct RemoteStats {
+    unsigned long requests;     /* Transfers of blocks */
+    unsigned long long bytes;   /* Bytes they fetched */
+    size_t blocks;              /* Blocks present */
+    size_t nblocks;             /* Blocks in the file */
+} RemoteStats;
+
+/* Is 'name' a URL remote_open() takes (whether or not this build can
+ * read its scheme)? */
+int remote_is_url(const char *name);
+
+/* Ask for the size of the file at 'url' and map its cache into 'file',
+ * nothing of it fetched yet. Returns the RemoteFile the blocks are
+ * fetched through, or NULL with a message in 'err'. */
+RemoteFile *remote_open(const char *url, LoadedFile *file, char *err, size_t errlen);
+
+/* Make the bytes [off, off + len) of the cache hold the file's, fetching
+ * the blocks missing. Safe from any thread. Returns 0, or -1 (see
+ * remote_error()). */
+int remote_fetch(RemoteFile *rf, size_t off, size_t len);
+
+/* Bytes from the start of the file that are present */
+size_t remote_prefix(const RemoteFile *rf);
+
+/* Why the last fetch failed */
+const char *remote_error(RemoteFile *rf);
+
+void remote_stats(RemoteFile *rf, RemoteStats *out);
+
+/* Free the cache. The mapping given by remote_open() is the caller's
+ * (see loader_close()). Safe on NULL. */
+void remote_close(RemoteFile *rf);
+
+/* Run 'program' (NULL: "ssh") for ssh:// URLs. For tests. */
+void remote_set_ssh_program(const char *program);
+
+#endif /* LOKI_REMOTE_H */
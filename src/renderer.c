@@ -2,6 +2,7 @@
  *
  * This file contains:
  * - Terminal renderer (VT100 escape sequences)
+ * - Capture renderer (the terminal renderer, offscreen)
  * - Null renderer (for testing)
  * - Helper functions
  */
@@ -10,6 +11,7 @@
 #include "internal.h"
 #include "terminal.h"
 #include "selection.h"
+#include "utf8.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,180 +35,609 @@ HighlightType hl_const_to_type(int hl_const) {
 
 /* ======================= Terminal Renderer ================================ */
 
+/* The terminal renderer paints each frame into a cell grid instead of
+ * writing escape sequences directly. end_frame() compares the grid with
+ * the previous frame and emits cursor moves plus only the runs of cells
+ * that changed, so moving the cursor or typing a character costs a few
+ * bytes instead of a full-screen redraw. When the text rows moved up or
+ * down as a block, the terminal is told to scroll them first, so only
+ * the newly exposed rows are drawn. */
+
+/* One screen cell */
+typedef struct {
+    char glyph[4];          /* UTF-8 bytes of the character */
+    unsigned char len;      /* Bytes used in glyph */
+    unsigned char hl;       /* HighlightType (foreground colour) */
+    unsigned char selected; /* Reverse video */
+    unsigned char bold;
+} TermCell;
+
+/* Unchanged cells shorter than this between two changed runs are
+ * rewritten rather than skipped with a cursor move. */
+#define TERM_DIFF_MIN_GAP 4
+
+/* Output buffer estimate for a full repaint (glyph plus some SGR) */
+#define TERM_FRAME_BYTES_PER_CELL 4
+
+/* A scroll must save at least this many line redraws to be worth the
+ * escape sequences it costs. */
+#define TERM_SCROLL_MIN_GAIN 2
+
 typedef struct {
     struct abuf ab;     /* Output buffer */
+    int fd;             /* Output file descriptor, -1 when capturing */
+    struct abuf captured;   /* Output kept by a capture renderer */
     int cols;           /* Screen columns */
     int rows;           /* Screen rows */
+
+    TermCell *cur;      /* Frame being painted, cap_lines x cols */
+    TermCell *prev;     /* Frame on the terminal */
+    int cap_lines;      /* Lines allocated in both grids */
+    int lines;          /* Lines painted in this frame */
+    int prev_lines;     /* Lines painted in the previous frame */
+    int prev_valid;     /* 0: repaint everything on the next frame */
+
+    int *row_lines;     /* Grid line of each text row in this frame */
+    int *prev_row_lines;/* ... and in the previous frame */
+    int row_cap;        /* Entries allocated in both arrays */
+    int row_count;      /* Text rows painted in this frame */
+    int prev_row_count; /* Text rows painted in the previous frame */
+    uint32_t *hashes;   /* Scratch for scroll detection, 2 x hash_cap */
+    int hash_cap;
+
+    int line, col;      /* Paint position */
+    int cursor_row, cursor_col;
+    int prev_cursor_row, prev_cursor_col;
+    int cursor_hidden;
+
+    TerminalRenderStats stats;
 } TerminalRendererData;
 
+static const TermCell blank_cell = {{' ', 0, 0, 0}, 1, HL_TYPE_NORMAL, 0, 0};
+
+/* Current paint attributes */
+typedef struct {
+    HighlightType hl;
+    int selected;
+    int bold;
+} TermPen;
+
+static int cell_equal(const TermCell *a, const TermCell *b) {
+    return a->len == b->len && a->hl == b->hl && a->selected == b->selected &&
+           a->bold == b->bold && memcmp(a->glyph, b->glyph, a->len) == 0;
+}
+
+static int cell_is_blank(const TermCell *c) {
+    return cell_equal(c, &blank_cell);
+}
+
+static TermCell *grid_line(TermCell *grid, const TerminalRendererData *data, int y) {
+    return grid + (size_t)y * data->cols;
+}
+
+/* Make room for 'need' lines in both grids. */
+static void ensure_lines(TerminalRendererData *data, int need) {
+    if (need <= data->cap_lines) return;
+
+    int newcap = data->cap_lines ? data->cap_lines * 2 : 64;
+    while (newcap < need) newcap *= 2;
+    size_t cells = (size_t)newcap * data->cols;
+    TermCell *cur = realloc(data->cur, cells * sizeof(TermCell));
+    TermCell *prev = cur ? realloc(data->prev, cells * sizeof(TermCell)) : NULL;
+    if (cur == NULL || prev == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    data->cur = cur;
+    data->prev = prev;
+    data->cap_lines = newcap;
+}
+
+/* Start painting line 'y', clearing it the first time it is reached. */
+static void paint_line(TerminalRendererData *data, int y) {
+    ensure_lines(data, y + 1);
+    while (data->lines <= y) {
+        TermCell *line = grid_line(data->cur, data, data->lines);
+        for (int x = 0; x < data->cols; x++) line[x] = blank_cell;
+        data->lines++;
+    }
+    data->line = y;
+    data->col = 0;
+}
+
+static void paint_newline(TerminalRendererData *data) {
+    paint_line(data, data->line + 1);
+}
+
+/* Remember that the current line holds the next text row. */
+static void note_text_row(TerminalRendererData *data) {
+    if (data->row_count == data->row_cap) {
+        int newcap = data->row_cap ? data->row_cap * 2 : 64;
+        int *cur = realloc(data->row_lines, newcap * sizeof(int));
+        int *prev = cur ? realloc(data->prev_row_lines, newcap * sizeof(int)) : NULL;
+        if (cur == NULL || prev == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        data->row_lines = cur;
+        data->prev_row_lines = prev;
+        data->row_cap = newcap;
+    }
+    data->row_lines[data->row_count++] = data->line;
+}
+
+/* Put 'len' bytes of glyph in the cell at the paint position */
+static void paint_cell(TerminalRendererData *data, TermCell *line,
+                       const char *glyph, int len, const TermPen *pen) {
+    if (data->col < data->cols) {
+        TermCell *cell = &line[data->col];
+        memcpy(cell->glyph, glyph, (size_t)len);
+        cell->len = (unsigned char)len;
+        cell->hl = (unsigned char)pen->hl;
+        cell->selected = (unsigned char)pen->selected;
+        cell->bold = (unsigned char)pen->bold;
+    }
+    data->col++;
+}
+
+/* Paint 'len' bytes of text at the paint position, one cell per UTF-8
+ * character; a wide one takes two, the second left empty (the terminal
+ * fills it), and a zero-width one goes in the cell before. Text past the
+ * right edge is dropped. */
+static void paint_text(TerminalRendererData *data, const char *s, int len,
+                       const TermPen *pen) {
+    TermCell *line = grid_line(data->cur, data, data->line);
+
+    for (int i = 0; i < len; ) {
+        int n = utf8_ascii_len(s + i, len - i);
+        for (int end = i + n; i < end; i++) paint_cell(data, line, s + i, 1, pen);
+        if (i >= len) break;
+
+        int cp;
+        n = utf8_decode(s + i, len - i, &cp);
+        int w = utf8_is_cont(s[i]) ? 0 : utf8_cp_width(cp);
+
+        /* Continuation byte or combining mark: extend the previous cell */
+        if (w == 0 && data->col > 0 && data->col <= data->cols) {
+            TermCell *last = &line[data->col - 1];
+            if (last->len + n <= (int)sizeof(last->glyph)) {
+                memcpy(last->glyph + last->len, s + i, (size_t)n);
+                last->len += (unsigned char)n;
+            }
+            i += n;
+            continue;
+        }
+        if (w == 2 && data->col + 1 >= data->cols) {
+            paint_cell(data, line, " ", 1, pen);    /* Would not fit */
+        } else {
+            paint_cell(data, line, s + i, n, pen);
+            if (w == 2) paint_cell(data, line, "", 0, pen);
+        }
+        i += n;
+    }
+}
+
+static void paint_repeat(TerminalRendererData *data, char c, int count,
+                         const TermPen *pen) {
+    for (int i = 0; i < count; i++) paint_text(data, &c, 1, pen);
+}
+
+/* ---------------------------- Frame output ------------------------------- */
+
+/* Write 'len' bytes to the terminal, or keep them when capturing */
+static int output(TerminalRendererData *data, const char *buf, size_t len) {
+    if (data->fd < 0) {
+        terminal_buffer_append(&data->captured, buf, (int)len);
+        return 0;
+    }
+    return terminal_write_all(data->fd, buf, len);
+}
+
+static unsigned long count_escapes(const char *buf, size_t len) {
+    unsigned long n = 0;
+    const char *end = buf + len;
+    while ((buf = memchr(buf, '\x1b', (size_t)(end - buf))) != NULL) {
+        n++;
+        buf++;
+    }
+    return n;
+}
+
+/* SGR sequence for every (highlight, selected, bold) combination, built
+ * once so emitting a pen is a table lookup. */
+typedef struct {
+    char seq[24];
+    unsigned char len;
+} PenSgr;
+
+static PenSgr pen_sgr[HL_TYPE_SELECTION + 1][2][2];
+static int pen_sgr_ready = 0;
+
+static void build_pen_sgr(void) {
+    for (int hl = 0; hl <= HL_TYPE_SELECTION; hl++) {
+        for (int selected = 0; selected < 2; selected++) {
+            for (int bold = 0; bold < 2; bold++) {
+                PenSgr *p = &pen_sgr[hl][selected][bold];
+                char *buf = p->seq;
+                size_t size = sizeof(p->seq);
+                int len = snprintf(buf, size, "\x1b[0");
+
+                if (bold) len += snprintf(buf + len, size - len, ";1");
+                if (selected || hl == HL_TYPE_NONPRINT)
+                    len += snprintf(buf + len, size - len, ";7");
+                switch (hl) {
+                    case HL_TYPE_COMMENT:  len += snprintf(buf + len, size - len, ";90"); break;
+                    case HL_TYPE_KEYWORD1: len += snprintf(buf + len, size - len, ";33"); break;
+                    case HL_TYPE_KEYWORD2: len += snprintf(buf + len, size - len, ";32"); break;
+                    case HL_TYPE_STRING:   len += snprintf(buf + len, size - len, ";36"); break;
+                    case HL_TYPE_NUMBER:   len += snprintf(buf + len, size - len, ";35"); break;
+                    case HL_TYPE_MATCH:    len += snprintf(buf + len, size - len, ";34"); break;
+                    default: break;
+                }
+                buf[len++] = 'm';
+                p->len = (unsigned char)len;
+            }
+        }
+    }
+    pen_sgr_ready = 1;
+}
+
+/* Append the SGR sequence selecting the attributes of 'cell'. */
+static void emit_pen(struct abuf *ab, const TermCell *cell) {
+    if (!pen_sgr_ready) build_pen_sgr();
+    int hl = cell->hl <= HL_TYPE_SELECTION ? cell->hl : HL_TYPE_NORMAL;
+    const PenSgr *p = &pen_sgr[hl][cell->selected != 0][cell->bold != 0];
+    terminal_buffer_append(ab, p->seq, p->len);
+}
+
+static int same_pen(const TermCell *a, const TermCell *b) {
+    return a->hl == b->hl && a->selected == b->selected && a->bold == b->bold;
+}
+
+static void emit_move(struct abuf *ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    terminal_buffer_append(ab, buf, len);
+}
+
+/* Emit the changes of line 'y' between 'old' and 'new'. *pen tracks the
+ * attributes the terminal is currently using (NULL if unknown). */
+static void diff_line(TerminalRendererData *data, int y, const TermCell *old,
+                      const TermCell *new, const TermCell **pen) {
+    struct abuf *ab = &data->ab;
+    int cols = data->cols;
+
+    /* Cells from blank_from on are all blank and can be cleared with EL */
+    int blank_from = cols;
+    while (blank_from > 0 && cell_is_blank(&new[blank_from - 1])) blank_from--;
+
+    int x = 0;
+    while (x < cols) {
+        if (cell_equal(&old[x], &new[x])) {
+            x++;
+            continue;
+        }
+
+        emit_move(ab, y, x);
+        if (x >= blank_from) {
+            if (*pen == NULL || !same_pen(*pen, &blank_cell)) {
+                emit_pen(ab, &blank_cell);
+                *pen = &blank_cell;
+            }
+            terminal_buffer_append(ab, "\x1b[0K", 4);
+            break;
+        }
+
+        /* Write the run, absorbing short unchanged gaps */
+        int end = x;
+        while (end < blank_from) {
+            if (!cell_equal(&old[end], &new[end])) {
+                end++;
+                continue;
+            }
+            int gap = end;
+            while (gap < blank_from && gap - end < TERM_DIFF_MIN_GAP &&
+                   cell_equal(&old[gap], &new[gap])) gap++;
+            if (gap == blank_from || gap - end >= TERM_DIFF_MIN_GAP) break;
+            end = gap;
+        }
+
+        for (; x < end; x++) {
+            if (*pen == NULL || !same_pen(*pen, &new[x])) {
+                emit_pen(ab, &new[x]);
+                *pen = &new[x];
+            }
+            terminal_buffer_append(ab, new[x].glyph, new[x].len);
+        }
+    }
+}
+
+/* FNV-1a hash of one grid line */
+static uint32_t line_hash(const TermCell *line, int cols) {
+    uint32_t h = 2166136261u;
+    for (int x = 0; x < cols; x++) {
+        const TermCell *c = &line[x];
+        for (int i = 0; i < c->len; i++) h = (h ^ (unsigned char)c->glyph[i]) * 16777619u;
+        h = (h ^ c->hl) * 16777619u;
+        h = (h ^ (unsigned)(c->selected | c->bold << 1)) * 16777619u;
+    }
+    return h;
+}
+
+/* Are the text rows of both frames the same contiguous block of lines? */
+static int text_rows_aligned(const TerminalRendererData *data) {
+    int n = data->row_count;
+    if (n < 2 || n != data->prev_row_count) return 0;
+    for (int i = 0; i < n; i++) {
+        if (data->row_lines[i] != data->row_lines[0] + i ||
+            data->prev_row_lines[i] != data->row_lines[i]) return 0;
+    }
+    return 1;
+}
+
+/* If the text rows moved vertically as a block, scroll them on the
+ * terminal with a DECSTBM region and SU/SD, and shift the previous grid
+ * to match, so the line diff only finds the exposed rows. */
+static void scroll_text_rows(TerminalRendererData *data) {
+    if (!text_rows_aligned(data)) return;
+
+    int n = data->row_count;
+    int top = data->row_lines[0];
+    if (n > data->hash_cap) {
+        uint32_t *h = realloc(data->hashes, 2 * (size_t)n * sizeof(uint32_t));
+        if (h == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        data->hashes = h;
+        data->hash_cap = n;
+    }
+    uint32_t *cur = data->hashes, *old = data->hashes + n;
+    for (int i = 0; i < n; i++) {
+        cur[i] = line_hash(grid_line(data->cur, data, top + i), data->cols);
+        old[i] = line_hash(grid_line(data->prev, data, top + i), data->cols);
+    }
+
+    /* Shift d: line i now shows what line i + d showed */
+    int best = 0, best_matches = 0;
+    for (int d = -(n - 1); d < n; d++) {
+        int matches = 0;
+        for (int i = 0; i < n; i++) {
+            if (i + d >= 0 && i + d < n && cur[i] == old[i + d]) matches++;
+        }
+        if (d == 0) matches += TERM_SCROLL_MIN_GAIN;
+        if (matches > best_matches) {
+            best = d;
+            best_matches = matches;
+        }
+    }
+    if (best == 0) return;
+
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[0m\x1b[%d;%dr\x1b[%d%c\x1b[r",
+                       top + 1, top + n, best > 0 ? best : -best,
+                       best > 0 ? 'S' : 'T');
+    terminal_buffer_append(&data->ab, buf, len);
+
+    TermCell *region = grid_line(data->prev, data, top);
+    size_t line_cells = (size_t)data->cols;
+    int d = best > 0 ? best : -best;
+    int keep = n - d;
+    TermCell *exposed;
+    if (best > 0) {
+        memmove(region, region + d * line_cells, keep * line_cells * sizeof(TermCell));
+        exposed = region + keep * line_cells;
+    } else {
+        memmove(region + d * line_cells, region, keep * line_cells * sizeof(TermCell));
+        exposed = region;
+    }
+    for (size_t x = 0; x < d * line_cells; x++) exposed[x] = blank_cell;
+}
+
 static void terminal_begin_frame(Renderer *r, int cols, int rows) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
+
+    if (cols < 1) cols = 1;
+    if (cols != data->cols || rows != data->rows) {
+        /* Geometry changed: the old frame is meaningless */
+        free(data->cur);
+        free(data->prev);
+        data->cur = data->prev = NULL;
+        data->cap_lines = 0;
+        data->prev_lines = 0;
+        data->prev_valid = 0;
+        data->prev_row_count = 0;
+    }
     data->cols = cols;
     data->rows = rows;
 
-    /* Reset buffer */
+    /* Reset buffer, keeping its allocation from earlier frames */
     data->ab.len = 0;
+    terminal_buffer_reserve(&data->ab, cols * rows * TERM_FRAME_BYTES_PER_CELL);
 
-    /* Hide cursor and go home */
-    terminal_buffer_append(&data->ab, "\x1b[?25l", 6);  /* Hide cursor */
-    terminal_buffer_append(&data->ab, "\x1b[H", 3);     /* Go home */
+    data->lines = 0;
+    data->row_count = 0;
+    data->cursor_row = data->cursor_col = 1;
+    data->cursor_hidden = 0;
+    paint_line(data, 0);
 }
 
 static void terminal_end_frame(Renderer *r) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
+    struct abuf *ab = &data->ab;
+    int full = !data->prev_valid;
+
+    int nlines = data->lines > data->prev_lines ? data->lines : data->prev_lines;
+    ensure_lines(data, nlines);
+    /* Hold the frame on the terminal until it is complete */
+    terminal_sync_begin(ab);
+    if (full) {
+        /* Compare against a blank screen */
+        terminal_buffer_append(ab, "\x1b[?25l", 6);
+        terminal_buffer_append(ab, "\x1b[0m\x1b[H\x1b[2J", 11);
+        data->prev_lines = 0;
+    } else {
+        /* Emit the "hide cursor" speculatively; drop it if nothing changes */
+        terminal_buffer_append(ab, "\x1b[?25l", 6);
+    }
+    int header = ab->len;
 
-    /* Show cursor */
-    terminal_buffer_append(&data->ab, "\x1b[?25h", 6);
+    /* Lines painted in only one of the two frames are blank in the other */
+    for (int y = data->lines; y < data->prev_lines; y++) {
+        TermCell *line = grid_line(data->cur, data, y);
+        for (int x = 0; x < data->cols; x++) line[x] = blank_cell;
+    }
+    for (int y = data->prev_lines; y < nlines; y++) {
+        TermCell *line = grid_line(data->prev, data, y);
+        for (int x = 0; x < data->cols; x++) line[x] = blank_cell;
+    }
+
+    if (!full) scroll_text_rows(data);
+
+    const TermCell *pen = full ? &blank_cell : NULL;
+    if (ab->len > header) pen = &blank_cell;  /* Scrolling reset the pen */
+    for (int y = 0; y < nlines; y++) {
+        diff_line(data, y, grid_line(data->prev, data, y),
+                  grid_line(data->cur, data, y), &pen);
+    }
+
+    int changed = full || ab->len > header;
+    if (changed && pen && !same_pen(pen, &blank_cell))
+        emit_pen(ab, &blank_cell);
+    if (!changed) ab->len = 0;
 
-    /* Flush buffer to terminal */
-    write(STDOUT_FILENO, data->ab.b, data->ab.len);
+    if (changed || data->cursor_row != data->prev_cursor_row ||
+        data->cursor_col != data->prev_cursor_col) {
+        emit_move(ab, data->cursor_row - 1, data->cursor_col - 1);
+    }
+    if (changed && !data->cursor_hidden)
+        terminal_buffer_append(ab, "\x1b[?25h", 6);
+    if (changed) terminal_sync_end(ab);
+
+    /* Flush buffer to terminal in one go */
+    if (ab->len > 0) output(data, ab->b, (size_t)ab->len);
+    data->stats.frame_bytes = (size_t)ab->len;
+    data->stats.total_bytes += (size_t)ab->len;
+    data->stats.frame_escapes = count_escapes(ab->b, (size_t)ab->len);
+    data->stats.total_escapes += data->stats.frame_escapes;
+    data->stats.frames++;
+
+    /* The painted frame is now on the terminal */
+    TermCell *tmp = data->prev;
+    data->prev = data->cur;
+    data->cur = tmp;
+    data->prev_lines = data->lines;
+    data->prev_valid = 1;
+    int *rows = data->prev_row_lines;
+    data->prev_row_lines = data->row_lines;
+    data->row_lines = rows;
+    data->prev_row_count = data->row_count;
+    data->prev_cursor_row = data->cursor_row;
+    data->prev_cursor_col = data->cursor_col;
 }
 
+/* --------------------------- Frame painting ------------------------------ */
+
 static void terminal_render_tabs(Renderer *r, const char **tabs, int tab_count,
                                  int active_tab, int width) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    struct abuf *ab = &data->ab;
+    TermPen pen = {HL_TYPE_NORMAL, 1, 0};  /* Reverse video */
 
     if (tab_count <= 1) return;
 
-    terminal_buffer_append(ab, "\x1b[7m", 4);  /* Reverse video */
-
     int col = 0;
     for (int i = 0; i < tab_count && col < width; i++) {
         const char *tab = tabs[i] ? tabs[i] : "???";
         int len = strlen(tab);
         if (len > 20) len = 20;
 
-        if (i == active_tab) {
-            terminal_buffer_append(ab, "\x1b[1m", 4);  /* Bold */
-        }
-
-        terminal_buffer_append(ab, " ", 1);
+        pen.bold = (i == active_tab);
+        paint_text(data, " ", 1, &pen);
         col++;
 
         int take = len;
         if (col + take > width - 1) take = width - col - 1;
         if (take > 0) {
-            terminal_buffer_append(ab, tab, take);
+            paint_text(data, tab, take, &pen);
             col += take;
         }
 
-        terminal_buffer_append(ab, " ", 1);
+        paint_text(data, " ", 1, &pen);
         col++;
-
-        if (i == active_tab) {
-            terminal_buffer_append(ab, "\x1b[22m", 5);  /* Normal intensity */
-        }
+        pen.bold = 0;
 
         if (i < tab_count - 1 && col < width) {
-            terminal_buffer_append(ab, "|", 1);
+            paint_text(data, "|", 1, &pen);
             col++;
         }
     }
 
     /* Pad rest of line */
-    while (col < width) {
-        terminal_buffer_append(ab, " ", 1);
-        col++;
-    }
-
-    terminal_buffer_append(ab, "\x1b[0m", 4);  /* Reset */
-    terminal_buffer_append(ab, "\r\n", 2);
+    if (col < width) paint_repeat(data, ' ', width - col, &pen);
+    paint_newline(data);
 }
 
 static void terminal_render_row(Renderer *r, int row_num,
                                 const RenderSegment *segments, int seg_count,
                                 int gutter_width, int is_empty) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    struct abuf *ab = &data->ab;
+    TermPen gutter = {HL_TYPE_COMMENT, 0, 0};  /* Dark gray */
+
+    note_text_row(data);
 
     /* Render gutter (line number) */
     if (gutter_width > 0) {
-        terminal_buffer_append(ab, "\x1b[90m", 5);  /* Dark gray */
         if (is_empty) {
             /* Empty row: show tilde */
-            for (int i = 0; i < gutter_width - 1; i++)
-                terminal_buffer_append(ab, " ", 1);
-            terminal_buffer_append(ab, "~", 1);
+            paint_repeat(data, ' ', gutter_width - 1, &gutter);
+            paint_text(data, "~", 1, &gutter);
+        } else if (row_num == 0) {
+            /* A wrapped row going on */
+            paint_repeat(data, ' ', gutter_width, &gutter);
         } else {
             char line_num_buf[16];
             int line_num_len = snprintf(line_num_buf, sizeof(line_num_buf),
                 "%*d ", gutter_width - 1, row_num);
-            terminal_buffer_append(ab, line_num_buf, line_num_len);
+            paint_text(data, line_num_buf, line_num_len, &gutter);
         }
-        terminal_buffer_append(ab, "\x1b[39m", 5);  /* Reset foreground */
     } else if (is_empty) {
-        terminal_buffer_append(ab, "~", 1);
+        TermPen normal = {HL_TYPE_NORMAL, 0, 0};
+        paint_text(data, "~", 1, &normal);
     }
 
     /* Render segments */
-    HighlightType current_type = HL_TYPE_NORMAL;
-    int in_selection = 0;
-
     for (int i = 0; i < seg_count; i++) {
         const RenderSegment *seg = &segments[i];
+        TermPen pen = {seg->hl_type, seg->selected, 0};
 
-        /* Handle selection */
-        if (seg->selected && !in_selection) {
-            terminal_buffer_append(ab, "\x1b[7m", 4);  /* Reverse video */
-            in_selection = 1;
-        } else if (!seg->selected && in_selection) {
-            terminal_buffer_append(ab, "\x1b[27m", 5);  /* Normal video */
-            in_selection = 0;
-        }
-
-        /* Handle highlight type change */
-        if (seg->hl_type != current_type) {
-            if (seg->hl_type == HL_TYPE_NONPRINT) {
-                if (!in_selection) {
-                    terminal_buffer_append(ab, "\x1b[7m", 4);
-                }
-            } else if (seg->hl_type == HL_TYPE_NORMAL) {
-                terminal_buffer_append(ab, "\x1b[39m", 5);
-            } else {
-                /* Use a simple color mapping */
-                const char *color_code = "\x1b[39m";
-                switch (seg->hl_type) {
-                    case HL_TYPE_COMMENT:  color_code = "\x1b[90m"; break;  /* Gray */
-                    case HL_TYPE_KEYWORD1: color_code = "\x1b[33m"; break;  /* Yellow */
-                    case HL_TYPE_KEYWORD2: color_code = "\x1b[32m"; break;  /* Green */
-                    case HL_TYPE_STRING:   color_code = "\x1b[36m"; break;  /* Cyan */
-                    case HL_TYPE_NUMBER:   color_code = "\x1b[35m"; break;  /* Magenta */
-                    case HL_TYPE_MATCH:    color_code = "\x1b[34m"; break;  /* Blue */
-                    default: break;
-                }
-                terminal_buffer_append(ab, color_code, strlen(color_code));
-            }
-            current_type = seg->hl_type;
-        }
-
-        /* Render text */
         if (seg->hl_type == HL_TYPE_NONPRINT && seg->len == 1) {
             /* Non-printable: show as ^X or ? */
             char sym = (seg->text[0] <= 26) ? '@' + seg->text[0] : '?';
-            terminal_buffer_append(ab, &sym, 1);
-            terminal_buffer_append(ab, "\x1b[0m", 4);  /* Reset */
-            current_type = HL_TYPE_NORMAL;
+            paint_text(data, &sym, 1, &pen);
         } else {
-            terminal_buffer_append(ab, seg->text, seg->len);
+            paint_text(data, seg->text, seg->len, &pen);
         }
     }
 
-    /* Reset and end line */
-    terminal_buffer_append(ab, "\x1b[39m", 5);  /* Reset foreground */
-    if (in_selection) {
-        terminal_buffer_append(ab, "\x1b[27m", 5);  /* Normal video */
-    }
-    terminal_buffer_append(ab, "\x1b[0K", 4);   /* Clear to end of line */
-    terminal_buffer_append(ab, "\r\n", 2);
+    paint_newline(data);
 }
 
-static void terminal_render_status(Renderer *r, const StatusInfo *info, int width) {
+/* Copy the cells of a row from the previous frame's grid. */
+static int terminal_reuse_row(Renderer *r, int prev_row) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    struct abuf *ab = &data->ab;
+    if (prev_row < 0 || prev_row >= data->prev_row_count) return 0;
+
+    note_text_row(data);
+    memcpy(grid_line(data->cur, data, data->line),
+           grid_line(data->prev, data, data->prev_row_lines[prev_row]),
+           (size_t)data->cols * sizeof(TermCell));
+    paint_newline(data);
+    return 1;
+}
 
-    terminal_buffer_append(ab, "\x1b[0K", 4);   /* Clear line */
-    terminal_buffer_append(ab, "\x1b[7m", 4);   /* Reverse video */
+static void terminal_render_status(Renderer *r, const StatusInfo *info, int width) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    TermPen pen = {HL_TYPE_NORMAL, 1, 0};  /* Reverse video */
 
     char status[80], rstatus[80];
 
@@ -224,40 +655,38 @@ static void terminal_render_status(Renderer *r, const StatusInfo *info, int widt
         playing, info->current_row, info->numrows);
 
     if (len > width) len = width;
-    terminal_buffer_append(ab, status, len);
+    paint_text(data, status, len, &pen);
 
     /* Pad and right-align */
     while (len < width) {
         if (width - len == rlen) {
-            terminal_buffer_append(ab, rstatus, rlen);
+            paint_text(data, rstatus, rlen, &pen);
             break;
         } else {
-            terminal_buffer_append(ab, " ", 1);
+            paint_text(data, " ", 1, &pen);
             len++;
         }
     }
 
-    terminal_buffer_append(ab, "\x1b[0m\r\n", 6);  /* Reset and newline */
+    paint_newline(data);
 }
 
 static void terminal_render_message(Renderer *r, const char *message, int width) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    struct abuf *ab = &data->ab;
-
-    terminal_buffer_append(ab, "\x1b[0K", 4);  /* Clear line */
+    TermPen pen = {HL_TYPE_NORMAL, 0, 0};
 
     if (message && *message) {
         int msglen = strlen(message);
         if (msglen > width) msglen = width;
-        terminal_buffer_append(ab, message, msglen);
+        paint_text(data, message, msglen, &pen);
     }
 }
 
 static void terminal_render_repl(Renderer *r, const ReplInfo *info, int width) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    struct abuf *ab = &data->ab;
+    TermPen pen = {HL_TYPE_NORMAL, 0, 0};
 
-    terminal_buffer_append(ab, "\r\n", 2);
+    paint_newline(data);
 
     /* Render log lines */
     int start = info->log_count - info->max_display_lines;
@@ -268,22 +697,20 @@ static void terminal_render_repl(Renderer *r, const ReplInfo *info, int width) {
         const char *line = info->log_lines[i] ? info->log_lines[i] : "";
         int take = strlen(line);
         if (take > width) take = width;
-        terminal_buffer_append(ab, "\x1b[0K", 4);
-        if (take > 0) terminal_buffer_append(ab, line, take);
-        terminal_buffer_append(ab, "\r\n", 2);
+        if (take > 0) paint_text(data, line, take, &pen);
+        paint_newline(data);
         rendered++;
     }
 
     /* Pad remaining lines */
     while (rendered < info->max_display_lines) {
-        terminal_buffer_append(ab, "\x1b[0K\r\n", 6);
+        paint_newline(data);
         rendered++;
     }
 
     /* Render prompt and input */
-    terminal_buffer_append(ab, "\x1b[0K", 4);
     if (info->prompt) {
-        terminal_buffer_append(ab, info->prompt, strlen(info->prompt));
+        paint_text(data, info->prompt, strlen(info->prompt), &pen);
     }
 
     int prompt_len = info->prompt ? strlen(info->prompt) : 0;
@@ -292,40 +719,43 @@ static void terminal_render_repl(Renderer *r, const ReplInfo *info, int width) {
     if (available > 0 && info->input_len > 0) {
         int shown = info->input_len;
         if (shown > available) shown = available;
-        terminal_buffer_append(ab, info->input, shown);
+        paint_text(data, info->input, shown, &pen);
     }
 }
 
 static void terminal_set_cursor(Renderer *r, int row, int col) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    char buf[32];
-    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, col);
-    terminal_buffer_append(&data->ab, buf, len);
+    data->cursor_row = row;
+    data->cursor_col = col;
 }
 
 static void terminal_show_cursor(Renderer *r) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    terminal_buffer_append(&data->ab, "\x1b[?25h", 6);
+    data->cursor_hidden = 0;
 }
 
 static void terminal_hide_cursor(Renderer *r) {
     TerminalRendererData *data = (TerminalRendererData *)r->data;
-    terminal_buffer_append(&data->ab, "\x1b[?25l", 6);
+    data->cursor_hidden = 1;
 }
 
-static int terminal_clipboard_copy(Renderer *r, const char *text, size_t len) {
-    (void)r;  /* Terminal renderer uses stdout directly */
-
-    /* Base64 encode */
-    char *encoded = base64_encode(text, len);
-    if (!encoded) return -1;
-
-    /* Send OSC 52 sequence: ESC]52;c;<base64>BEL */
-    printf("\033]52;c;%s\007", encoded);
-    fflush(stdout);
-    free(encoded);
+static int terminal_write_raw(Renderer *r, const char *buf, size_t len) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    return output(data, buf, len);
+}
 
-    return 0;
+static int terminal_clipboard_copy(Renderer *r, const char *text, size_t len) {
+    /* Send OSC 52 sequence: ESC]52;c;<base64>BEL, encoded a chunk at a
+     * time rather than into a copy of the whole text */
+    char chunk[BASE64_LEN(3 * 1024) + 4];
+    if (terminal_write_raw(r, "\033]52;c;", 7) != 0) return -1;
+    while (len > 0) {
+        size_t take = len < 3 * 1024 ? len : 3 * 1024;
+        if (terminal_write_raw(r, chunk, base64_encode_to(text, take, chunk)) != 0) return -1;
+        text += take;
+        len -= take;
+    }
+    return terminal_write_raw(r, "\007", 1);
 }
 
 static void terminal_destroy(Renderer *r) {
@@ -333,13 +763,19 @@ static void terminal_destroy(Renderer *r) {
         TerminalRendererData *data = (TerminalRendererData *)r->data;
         if (data) {
             terminal_buffer_free(&data->ab);
+            terminal_buffer_free(&data->captured);
+            free(data->cur);
+            free(data->prev);
+            free(data->row_lines);
+            free(data->prev_row_lines);
+            free(data->hashes);
             free(data);
         }
         free(r);
     }
 }
 
-Renderer *terminal_renderer_create(void) {
+Renderer *terminal_renderer_create_fd(int fd) {
     Renderer *r = calloc(1, sizeof(Renderer));
     if (!r) return NULL;
 
@@ -350,12 +786,15 @@ Renderer *terminal_renderer_create(void) {
     }
 
     data->ab = (struct abuf)ABUF_INIT;
+    data->captured = (struct abuf)ABUF_INIT;
+    data->fd = fd;
 
     r->data = data;
     r->begin_frame = terminal_begin_frame;
     r->end_frame = terminal_end_frame;
     r->render_tabs = terminal_render_tabs;
     r->render_row = terminal_render_row;
+    r->reuse_row = terminal_reuse_row;
     r->render_status = terminal_render_status;
     r->render_message = terminal_render_message;
     r->render_repl = terminal_render_repl;
@@ -363,11 +802,84 @@ Renderer *terminal_renderer_create(void) {
     r->show_cursor = terminal_show_cursor;
     r->hide_cursor = terminal_hide_cursor;
     r->clipboard_copy = terminal_clipboard_copy;
+    r->write_raw = terminal_write_raw;
     r->destroy = terminal_destroy;
 
     return r;
 }
 
+Renderer *terminal_renderer_create(void) {
+    return terminal_renderer_create_fd(STDOUT_FILENO);
+}
+
+void terminal_renderer_invalidate(Renderer *r) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    data->prev_valid = 0;
+}
+
+void terminal_renderer_get_stats(Renderer *r, TerminalRenderStats *stats) {
+    if (r->begin_frame != terminal_begin_frame) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    *stats = data->stats;
+}
+
+/* ======================= Capture Renderer ================================= */
+
+/* A terminal renderer without a terminal: frames are painted, diffed and
+ * encoded exactly as for one, and the bytes kept for the caller. */
+Renderer *capture_renderer_create(void) {
+    return terminal_renderer_create_fd(-1);
+}
+
+const char *capture_renderer_output(Renderer *r, size_t *len) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    *len = (size_t)data->captured.len;
+    return data->captured.len ? data->captured.b : "";
+}
+
+void capture_renderer_clear(Renderer *r) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    data->captured.len = 0;
+}
+
+/* The last frame is in 'prev' once end_frame() swapped the grids */
+static const TermCell *captured_cell(Renderer *r, int y, int x) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    if (!data->prev_valid || y < 0 || y >= data->prev_lines ||
+        x < 0 || x >= data->cols) return NULL;
+    return &grid_line(data->prev, data, y)[x];
+}
+
+int capture_renderer_line(Renderer *r, int y, char *buf, size_t size) {
+    TerminalRendererData *data = (TerminalRendererData *)r->data;
+    if (size == 0 || captured_cell(r, y, 0) == NULL) return -1;
+
+    size_t len = 0;
+    for (int x = 0; x < data->cols; x++) {
+        const TermCell *cell = captured_cell(r, y, x);
+        if (len + cell->len >= size) break;
+        memcpy(buf + len, cell->glyph, cell->len);
+        len += cell->len;
+    }
+    while (len > 0 && buf[len - 1] == ' ') len--;
+    buf[len] = '\0';
+    return (int)len;
+}
+
+int capture_renderer_cell(Renderer *r, int y, int x, CaptureCell *cell) {
+    const TermCell *c = captured_cell(r, y, x);
+    if (c == NULL) return -1;
+    memcpy(cell->glyph, c->glyph, c->len);
+    cell->glyph[c->len] = '\0';
+    cell->hl = (HighlightType)c->hl;
+    cell->selected = c->selected;
+    cell->bold = c->bold;
+    return 0;
+}
+
 /* ======================= Null Renderer ==================================== */
 
 static void null_begin_frame(Renderer *r, int cols, int rows) {
@@ -390,6 +902,11 @@ static void null_render_row(Renderer *r, int row_num,
     (void)gutter_width; (void)is_empty;
 }
 
+static int null_reuse_row(Renderer *r, int prev_row) {
+    (void)r; (void)prev_row;
+    return 1;  /* Nothing to repeat */
+}
+
 static void null_render_status(Renderer *r, const StatusInfo *info, int width) {
     (void)r; (void)info; (void)width;
 }
@@ -432,6 +949,7 @@ Renderer *null_renderer_create(void) {
     r->end_frame = null_end_frame;
     r->render_tabs = null_render_tabs;
     r->render_row = null_render_row;
+    r->reuse_row = null_reuse_row;
     r->render_status = null_render_status;
     r->render_message = null_render_message;
     r->render_repl = null_render_repl;
@@ -132,7 +132,8 @@ struct Renderer {
     /**
      * Render a single row of text content.
      * @param r          Renderer instance
-     * @param row_num    Row number (1-based, for gutter display)
+     * @param row_num    Row number (1-based, for gutter display); 0 for
+     *                   the rows a wrapped row goes on to, blank there
      * @param segments   Array of render segments
      * @param seg_count  Number of segments
      * @param gutter_width  Width of line number gutter (0 to disable)
@@ -141,6 +142,18 @@ struct Renderer {
     void (*render_row)(Renderer *r, int row_num, const RenderSegment *segments,
                        int seg_count, int gutter_width, int is_empty);
 
+    /**
+     * Render a row exactly as the given row of the previous frame, in
+     * place of render_row(). Lets the editor skip building segments for
+     * rows that did not change. Optional (may be NULL).
+     * @param r         Renderer instance
+     * @param prev_row  Index among the render_row()/reuse_row() calls of
+     *                  the previous frame
+     * @return 1 if the row was rendered, 0 if the renderer cannot repeat
+     *         it (the caller then uses render_row())
+     */
+    int (*reuse_row)(Renderer *r, int prev_row);
+
     /**
      * Render the status bar.
      * @param r      Renderer instance
@@ -198,6 +211,17 @@ struct Renderer {
      */
     int (*clipboard_copy)(Renderer *r, const char *text, size_t len);
 
+    /**
+     * Write bytes straight to the terminal, outside any frame, such as
+     * an OSC 52 sequence written as it is encoded. NULL for renderers
+     * without a terminal; they are given the text by clipboard_copy.
+     * @param r    Renderer instance
+     * @param buf  Bytes to write
+     * @param len  Number of bytes
+     * @return 0 on success, -1 on failure
+     */
+    int (*write_raw)(Renderer *r, const char *buf, size_t len);
+
     /* ==================== Lifecycle ==================== */
 
     /**
@@ -220,6 +244,90 @@ struct Renderer {
  */
 Renderer *terminal_renderer_create(void);
 
+/**
+ * Create a terminal renderer writing to 'fd' instead of stdout.
+ * @param fd  Output file descriptor (not closed by destroy)
+ * @return Renderer instance, or NULL on error
+ */
+Renderer *terminal_renderer_create_fd(int fd);
+
+/**
+ * TerminalRenderStats - Output volume of a terminal renderer.
+ *
+ * The terminal renderer diffs each frame against the previous one and
+ * only emits changed cells; these counters measure how much that saves.
+ */
+typedef struct {
+    size_t frame_bytes;     /* Bytes written for the last frame */
+    size_t total_bytes;     /* Bytes written since creation */
+    unsigned long frames;   /* Frames rendered since creation */
+    unsigned long frame_escapes;    /* Escape sequences in the last frame */
+    unsigned long total_escapes;    /* ... and since creation */
+} TerminalRenderStats;
+
+/**
+ * Get output statistics of a terminal renderer (all zero for another).
+ * @param r      Renderer created by terminal_renderer_create()
+ * @param stats  Receives the counters
+ */
+void terminal_renderer_get_stats(Renderer *r, TerminalRenderStats *stats);
+
+/**
+ * Forget the previous frame so the next one repaints the whole screen.
+ * Call after anything else has written to the terminal.
+ * @param r  Renderer created by terminal_renderer_create()
+ */
+void terminal_renderer_invalidate(Renderer *r);
+
+/**
+ * Create a capture renderer: a terminal renderer that keeps its output in
+ * memory instead of writing it, for tests and benchmarks. It paints, diffs
+ * and encodes frames exactly as for a terminal, and
+ * terminal_renderer_get_stats() and terminal_renderer_invalidate() apply.
+ * @return Renderer instance, or NULL on error
+ */
+Renderer *capture_renderer_create(void);
+
+/**
+ * Get the bytes a capture renderer wrote since creation or the last
+ * capture_renderer_clear().
+ * @param r    Renderer created by capture_renderer_create()
+ * @param len  Receives their length
+ * @return The bytes (not null-terminated), valid until the next frame
+ */
+const char *capture_renderer_output(Renderer *r, size_t *len);
+
+/**
+ * Forget the bytes a capture renderer wrote so far.
+ * @param r  Renderer created by capture_renderer_create()
+ */
+void capture_renderer_clear(Renderer *r);
+
+/**
+ * CaptureCell - One cell of the screen a capture renderer drew.
+ */
+typedef struct {
+    char glyph[5];          /* UTF-8 character, null-terminated */
+    HighlightType hl;
+    int selected;
+    int bold;
+} CaptureCell;
+
+/**
+ * Get the text of screen line 'y' (0-based) of the last frame, without
+ * trailing blanks.
+ * @param r     Renderer created by capture_renderer_create()
+ * @param buf   Receives the text, null-terminated (cut at 'size')
+ * @return Its length, or -1 if the last frame has no line 'y'
+ */
+int capture_renderer_line(Renderer *r, int y, char *buf, size_t size);
+
+/**
+ * Get cell ('y', 'x') (0-based) of the last frame.
+ * @return 0, or -1 if the last frame has no such cell
+ */
+int capture_renderer_cell(Renderer *r, int y, int x, CaptureCell *cell);
+
 /**
  * Create a null renderer that discards all output.
  * Useful for testing or headless operation.
@@ -11,6 +11,7 @@
 #include "loki/core.h"
 #include "terminal.h"
 #include "syntax.h"
+#include "history.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,7 +49,9 @@ void repl_editor_cleanup(ReplLineEditor *ed) {
     for (int i = 0; i < ed->history_len; i++) {
         free(ed->history[i]);
     }
+    history_close(ed->log);
     repl_completion_clear(ed);
+    completion_index_free(ed->completion_words);
 
 #ifdef LOKI_USE_LINENOISE
     /* Don't destroy context here - it's managed by repl_linenoise module */
@@ -59,10 +62,42 @@ void repl_editor_cleanup(ReplLineEditor *ed) {
 }
 
 void repl_set_completion_words(ReplLineEditor *ed, const char **words, int count) {
-    ed->completion_words = words;
-    ed->completion_word_count = count;
+    if (!ed->completion_words)
+        ed->completion_words = completion_index_new();
+    completion_index_begin(ed->completion_words, COMPLETION_SOURCE_WORDS);
+    for (int i = 0; i < count && words; i++) {
+        if (words[i])
+            completion_index_add(ed->completion_words, words[i], strlen(words[i]),
+                                 COMPLETION_SOURCE_WORDS);
+    }
+    completion_index_end(ed->completion_words, COMPLETION_SOURCE_WORDS);
 }
 
+/* The index's words for 'prefix', best first, strdup'd (or NULL) */
+static char **repl_completions_from_words(const CompletionIndex *ix,
+                                           const char *prefix, int *out_count) {
+    *out_count = 0;
+    if (!ix || completion_index_count(ix) == 0) return NULL;
+
+    const char *words[REPL_COMPLETIONS_MAX];
+    int matches = completion_index_query(ix, prefix, strlen(prefix), words, REPL_COMPLETIONS_MAX);
+    if (matches == 0) return NULL;
+
+    char **result = malloc(sizeof(char*) * matches);
+    if (!result) return NULL;
+    for (int i = 0; i < matches; i++) {
+        result[i] = strdup(words[i]);
+        if (!result[i]) {
+            for (int j = 0; j < i; j++) free(result[j]);
+            free(result);
+            return NULL;
+        }
+    }
+    *out_count = matches;
+    return result;
+}
+
+
 #ifdef LOKI_USE_LINENOISE
 /* Adapter structure to pass to linenoise completion callback */
 static ReplLineEditor *g_completion_editor = NULL;
@@ -93,26 +128,7 @@ static void linenoise_completion_adapter(const char *buf, linenoise_completions_
     if (ed->completion_cb) {
         completions = ed->completion_cb(prefix, &count, ed->completion_user_data);
     } else if (ed->completion_words) {
-        /* Generate from word list */
-        for (int i = 0; i < ed->completion_word_count; i++) {
-            if (ed->completion_words[i] &&
-                strncmp(ed->completion_words[i], prefix, word_len) == 0) {
-                count++;
-            }
-        }
-        if (count > 0) {
-            completions = malloc(sizeof(char*) * count);
-            if (completions) {
-                int idx = 0;
-                for (int i = 0; i < ed->completion_word_count && idx < count; i++) {
-                    if (ed->completion_words[i] &&
-                        strncmp(ed->completion_words[i], prefix, word_len) == 0) {
-                        completions[idx] = strdup(ed->completion_words[i]);
-                        idx++;
-                    }
-                }
-            }
-        }
+        completions = repl_completions_from_words(ed->completion_words, prefix, &count);
     }
 
     /* Add completions to linenoise */
@@ -160,9 +176,8 @@ void repl_completion_clear(ReplLineEditor *ed) {
     ed->completion.word_len = 0;
 }
 
-void repl_add_history(ReplLineEditor *ed, const char *line) {
-    if (!line || !line[0]) return;
-
+/* Add a line to the history in memory */
+static void repl_remember(ReplLineEditor *ed, const char *line) {
     /* Don't add duplicates of the last entry */
     if (ed->history_len > 0 && strcmp(ed->history[ed->history_len - 1], line) == 0) {
         return;
@@ -185,38 +200,45 @@ void repl_add_history(ReplLineEditor *ed, const char *line) {
 #endif
 }
 
-int repl_history_load(ReplLineEditor *ed, const char *filepath) {
-    if (!ed || !filepath) return -1;
-
-#ifdef LOKI_USE_LINENOISE
-    /* Use linenoise history loading */
-    if (ed->ln_ctx) {
-        return linenoise_history_load(ed->ln_ctx, filepath);
-    }
-#endif
+void repl_add_history(ReplLineEditor *ed, const char *line) {
+    if (!line || !line[0]) return;
+    if (ed->log) history_add(ed->log, line);
+    repl_remember(ed, line);
+}
 
-    FILE *f = fopen(filepath, "r");
-    if (!f) return -1;  /* File doesn't exist yet, not an error */
+int repl_history_load(ReplLineEditor *ed, const char *filepath) {
+    if (!ed || !filepath || !filepath[0]) return -1;
 
-    char line[MAX_INPUT_LENGTH];
-    while (fgets(line, sizeof(line), f)) {
-        /* Remove trailing newline */
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
-        /* Skip empty lines */
-        if (line[0] != '\0') {
-            repl_add_history(ed, line);
+    char path[MAX_INPUT_LENGTH];
+    snprintf(path, sizeof(path), "%s.log", filepath);
+    history_close(ed->log);
+    ed->log = history_open_path(path);
+    if (!ed->log) return -1;
+
+    /* The lines of the history file as it was, once */
+    FILE *f = history_count(ed->log) == 0 ? fopen(filepath, "r") : NULL;
+    if (f) {
+        char line[MAX_INPUT_LENGTH];
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') history_add(ed->log, line);
         }
+        fclose(f);
     }
 
-    fclose(f);
+    /* Only the newest are read; the log has the rest */
+    int n = history_count(ed->log);
+    if (n > REPL_HISTORY_MAX) n = REPL_HISTORY_MAX;
+    for (int age = n - 1; age >= 0; age--) {
+        const char *entry = history_get(ed->log, age);
+        if (entry) repl_remember(ed, entry);
+    }
     return 0;
 }
 
 int repl_history_save(ReplLineEditor *ed, const char *filepath) {
     if (!ed || !filepath || !filepath[0]) return -1;
+    if (ed->log) return 0;      /* Appended as they were added */
 
 #ifdef LOKI_USE_LINENOISE
     /* Use linenoise history saving */
@@ -509,51 +531,6 @@ static int repl_find_word_start(const char *buf, int pos) {
     return start;
 }
 
-static char **repl_completions_from_words(const char **words, int word_count,
-                                           const char *prefix, int *out_count) {
-    if (!words || word_count == 0) {
-        *out_count = 0;
-        return NULL;
-    }
-
-    size_t prefix_len = prefix ? strlen(prefix) : 0;
-
-    int matches = 0;
-    for (int i = 0; i < word_count; i++) {
-        if (words[i] && strncmp(words[i], prefix, prefix_len) == 0) {
-            matches++;
-        }
-    }
-
-    if (matches == 0) {
-        *out_count = 0;
-        return NULL;
-    }
-
-    char **result = malloc(sizeof(char*) * matches);
-    if (!result) {
-        *out_count = 0;
-        return NULL;
-    }
-
-    int idx = 0;
-    for (int i = 0; i < word_count && idx < matches; i++) {
-        if (words[i] && strncmp(words[i], prefix, prefix_len) == 0) {
-            result[idx] = strdup(words[i]);
-            if (!result[idx]) {
-                for (int j = 0; j < idx; j++) free(result[j]);
-                free(result);
-                *out_count = 0;
-                return NULL;
-            }
-            idx++;
-        }
-    }
-
-    *out_count = matches;
-    return result;
-}
-
 static void repl_handle_tab(editor_ctx_t *syntax_ctx, ReplLineEditor *ed, const char *prompt) {
     if (!ed->completion_cb && !ed->completion_words) return;
 
@@ -596,9 +573,7 @@ static void repl_handle_tab(editor_ctx_t *syntax_ctx, ReplLineEditor *ed, const
     if (ed->completion_cb) {
         completions = ed->completion_cb(prefix, &count, ed->completion_user_data);
     } else {
-        completions = repl_completions_from_words(ed->completion_words,
-                                                   ed->completion_word_count,
-                                                   prefix, &count);
+        completions = repl_completions_from_words(ed->completion_words, prefix, &count);
     }
 
     if (!completions || count == 0) {
@@ -7,6 +7,7 @@
 #define PSND_REPL_H
 
 #include "internal.h"
+#include "completion.h"
 
 #ifdef LOKI_USE_LINENOISE
 #include <linenoise.h>
@@ -56,11 +57,11 @@ typedef struct {
     int history_idx;                 /* Current history index (-1 = current input) */
     char saved_buf[MAX_INPUT_LENGTH];/* Saved current input when browsing history */
     int saved_len;                   /* Saved length */
+    struct HistoryLog *log;          /* Where lines added go, if loaded (history.h) */
     unsigned char hl[MAX_INPUT_LENGTH]; /* Highlight types per character */
 
     /* Completion support - word list (standard mechanism) */
-    const char **completion_words;         /* NULL-terminated array of completion words */
-    int completion_word_count;             /* Number of words in array */
+    CompletionIndex *completion_words;     /* The words, indexed (owned) */
 
     /* Completion support - callback (advanced, optional) */
     ReplCompletionCallback completion_cb;  /* Custom callback (overrides word list) */
@@ -85,10 +86,12 @@ void repl_editor_cleanup(ReplLineEditor *ed);
 /* Add a line to history */
 void repl_add_history(ReplLineEditor *ed, const char *line);
 
-/* Load history from file (one entry per line) */
+/* Load the newest REPL_HISTORY_MAX entries of the history log at
+ * 'filepath'.log (see history.h), taking in the lines of 'filepath' the
+ * first time, and append the lines added from then on to it */
 int repl_history_load(ReplLineEditor *ed, const char *filepath);
 
-/* Save history to file (one entry per line) */
+/* Save history to file (one entry per line), unless it is in a log */
 int repl_history_save(ReplLineEditor *ed, const char *filepath);
 
 /* Enable/disable terminal raw mode for REPL */
@@ -104,7 +107,9 @@ void repl_highlight_line(editor_ctx_t *syntax_ctx, ReplLineEditor *ed);
 /* Render the current line with highlighting */
 void repl_render_line(editor_ctx_t *syntax_ctx, ReplLineEditor *ed, const char *prompt);
 
-/* Set completion words for TAB completion (standard mechanism) */
+/* Set completion words for TAB completion (standard mechanism): the words
+ * are copied into an index, replacing those set before; prefix matches
+ * come first, then fuzzy ones */
 void repl_set_completion_words(ReplLineEditor *ed, const char **words, int count);
 
 /* Set completion callback for TAB completion (advanced, overrides word list) */
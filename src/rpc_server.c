@@ -0,0 +1,615 @@
+/* rpc_server.c - The JSON-RPC harness served over sockets
+ *
+ * Each connection is a JsonRpcPeer (jsonrpc.h) fed what the socket reads;
+ * the peer's responses are appended to the connection's output, which is
+ * handed to uv_write() whole once the read is processed (with whatever
+ * notifications other connections' commands caused). Sessions are kept
+ * in a list, each with the number of connections attached to it.
+ *
+ * A connection's first bytes tell what it is: "GET " starts an HTTP
+ * request, answered with the WebSocket handshake if it asks for one (the
+ * peer then fed the messages, and its responses to a read gathered into
+ * one message), or with a file of the web root, and anything else is a
+ * client of the protocol as it is.
+ */
+
+#define _DEFAULT_SOURCE     /* strdup() */
+
+#include "rpc_server.h"
+#include "jsonrpc.h"
+#include "websocket.h"
+#include <uv.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Bytes read from a socket at a time */
+#define RPC_SERVER_READ_SIZE 65536
+
+/* Most connections listen() lets wait to be accepted */
+#define RPC_SERVER_BACKLOG 64
+
+/* Largest file of the web root served */
+#define RPC_SERVER_FILE_MAX ((off_t)64 << 20)
+
+typedef union {
+    uv_handle_t handle;
+    uv_stream_t stream;
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+} RpcSocket;
+
+typedef struct RpcSessionEntry {
+    char *name;                 /* NULL for a connection's own session */
+    EditorSession *session;
+    int clients;                /* Connections attached to it */
+    struct RpcSessionEntry *next;
+} RpcSessionEntry;
+
+typedef struct RpcConn {
+    RpcSocket sock;
+    struct RpcServer *server;
+    JsonRpcPeer *peer;
+    RpcSessionEntry *entry;
+    char *out;                  /* Responses not yet handed to uv_write() */
+    size_t out_len;
+    size_t out_cap;
+    size_t pending;             /* Bytes handed to uv_write() and not written yet */
+    int paused;                 /* Not reading until 'pending' drains */
+    int closing;
+    int sniffed;                /* Its first bytes were looked at */
+    int http;                   /* They were "GET " */
+    char *head;                 /* HTTP: the request head so far */
+    size_t head_len;
+    WsSocket *ws;               /* A browser, after the handshake */
+    char *msg;                  /* WebSocket: responses for the next message */
+    size_t msg_len;
+    size_t msg_cap;
+    int quit;
+    uv_shutdown_t shutdown;
+    struct RpcConn *next;
+} RpcConn;
+
+typedef struct {
+    uv_write_t req;
+    RpcConn *conn;
+    char *data;
+    size_t len;
+} RpcWrite;
+
+struct RpcServer {
+    uv_loop_t *loop;
+    RpcSocket listener;
+    int is_tcp;
+    char *unix_path;            /* Removed when the server closes */
+    EditorConfig config;
+    char *web_root;             /* Files served to plain GETs, or NULL */
+    RpcSessionEntry *sessions;
+    RpcConn *conns;
+    int clients;
+    int handles;                /* Handles open, or closing */
+    char read_buf[RPC_SERVER_READ_SIZE];
+};
+
+/* ======================= Sessions ========================================== */
+
+static RpcSessionEntry *session_add(RpcServer *server, const char *name) {
+    RpcSessionEntry *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->session = editor_session_new(&server->config);
+    e->name = name ? strdup(name) : NULL;
+    if (!e->session || (name && !e->name)) {
+        editor_session_free(e->session);
+        free(e->name);
+        free(e);
+        return NULL;
+    }
+    e->next = server->sessions;
+    server->sessions = e;
+    return e;
+}
+
+static void session_release(RpcServer *server, RpcSessionEntry *e) {
+    if (!e || --e->clients > 0) return;
+    for (RpcSessionEntry **p = &server->sessions; *p; p = &(*p)->next) {
+        if (*p == e) {
+            *p = e->next;
+            break;
+        }
+    }
+    editor_session_free(e->session);
+    free(e->name);
+    free(e);
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+/* ======================= Output ============================================ */
+
+static void on_write(uv_write_t *req, int status) {
+    RpcWrite *w = (RpcWrite *)req;
+    RpcConn *conn = w->conn;
+    (void)status;
+    conn->pending -= w->len;
+    free(w->data);
+    free(w);
+
+    if (conn->paused && !conn->closing && conn->pending < RPC_SERVER_LOW_WATER) {
+        conn->paused = 0;
+        uv_read_start(&conn->sock.stream, on_alloc, on_read);
+    }
+}
+
+/* Append 'len' bytes to a growing buffer */
+static void buf_append(char **buf, size_t *used, size_t *cap, const char *data, size_t len) {
+    if (*used + len > *cap) {
+        size_t n = *cap ? *cap * 2 : 4096;
+        while (n < *used + len) n *= 2;
+        char *grown = realloc(*buf, n);
+        if (!grown) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *buf = grown;
+        *cap = n;
+    }
+    memcpy(*buf + *used, data, len);
+    *used += len;
+}
+
+/* Hand the connection's output to uv_write(), buffer and all: for a
+ * WebSocket, the responses gathered as one message first */
+static void conn_flush(RpcConn *conn) {
+    if (conn->ws && conn->msg_len > 0) {
+        ws_send(conn->ws, ws_last_opcode(conn->ws), conn->msg, conn->msg_len);
+        conn->msg_len = 0;
+    }
+    if (conn->out_len == 0) return;
+    RpcWrite *w = malloc(sizeof(*w));
+    if (!w) {
+        perror("Out of memory");
+        exit(1);
+    }
+    w->conn = conn;
+    w->data = conn->out;
+    w->len = conn->out_len;
+    conn->out = NULL;
+    conn->out_len = conn->out_cap = 0;
+
+    uv_buf_t buf = uv_buf_init(w->data, (unsigned int)w->len);
+    if (uv_write(&w->req, &conn->sock.stream, &buf, 1, on_write) != 0) {
+        free(w->data);
+        free(w);
+        return;
+    }
+    conn->pending += w->len;
+}
+
+static void server_flush(RpcServer *server) {
+    for (RpcConn *c = server->conns; c; c = c->next) conn_flush(c);
+}
+
+/* ======================= Peer Callbacks ==================================== */
+
+/* Bytes for the socket as they are */
+static void conn_write_raw(void *opaque, const char *data, size_t len) {
+    RpcConn *conn = opaque;
+    buf_append(&conn->out, &conn->out_len, &conn->out_cap, data, len);
+}
+
+static void conn_write(void *opaque, const char *data, size_t len) {
+    RpcConn *conn = opaque;
+    if (conn->ws)
+        buf_append(&conn->msg, &conn->msg_len, &conn->msg_cap, data, len);
+    else
+        conn_write_raw(conn, data, len);
+}
+
+static EditorSession *conn_attach(void *opaque, const char *name) {
+    RpcConn *conn = opaque;
+    RpcServer *server = conn->server;
+    RpcSessionEntry *e = server->sessions;
+    while (e && !(e->name && strcmp(e->name, name) == 0)) e = e->next;
+    if (e == conn->entry) return e->session;
+    if (!e && !(e = session_add(server, name))) return NULL;
+
+    e->clients++;
+    session_release(server, conn->entry);
+    conn->entry = e;
+    return e->session;
+}
+
+/* Tell the other clients of the session */
+static void conn_changed(void *opaque, EditorSession *session) {
+    RpcConn *conn = opaque;
+    (void)session;
+    for (RpcConn *c = conn->server->conns; c; c = c->next) {
+        if (c != conn && c->entry == conn->entry && !c->closing)
+            jsonrpc_peer_notify(c->peer, "changed", conn->entry->name);
+    }
+}
+
+/* ======================= Connections ======================================= */
+
+static void on_handle_closed(uv_handle_t *handle) {
+    RpcServer *server = handle->data;
+    server->handles--;
+}
+
+static void on_conn_closed(uv_handle_t *handle) {
+    RpcConn *conn = handle->data;
+    conn->server->handles--;
+    ws_free(conn->ws);
+    free(conn->head);
+    free(conn->msg);
+    free(conn->out);
+    free(conn);
+}
+
+/* Forget the connection, and close its socket */
+static void conn_close(RpcConn *conn) {
+    RpcServer *server = conn->server;
+    for (RpcConn **p = &server->conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    server->clients--;
+    jsonrpc_peer_free(conn->peer);
+    conn->peer = NULL;
+    session_release(server, conn->entry);
+    conn->entry = NULL;
+    conn->closing = 1;
+    uv_close(&conn->sock.handle, on_conn_closed);
+}
+
+static void on_shutdown(uv_shutdown_t *req, int status) {
+    (void)status;
+    conn_close(req->data);
+}
+
+/* Close once what was written to it is sent */
+static void conn_end(RpcConn *conn) {
+    if (conn->closing) return;
+    conn->closing = 1;
+    uv_read_stop(&conn->sock.stream);
+    conn->shutdown.data = conn;
+    if (uv_shutdown(&conn->shutdown, &conn->sock.stream, on_shutdown) != 0) conn_close(conn);
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    RpcConn *conn = handle->data;
+    (void)suggested;
+    *buf = uv_buf_init(conn->server->read_buf, sizeof(conn->server->read_buf));
+}
+
+/* ======================= HTTP and WebSockets =============================== */
+
+/* A message of the browser: commands, a line of JSON each (its last need
+ * not end in a newline) or MessagePack */
+static void ws_message(void *opaque, int opcode, const char *data, size_t len) {
+    RpcConn *conn = opaque;
+    if (conn->quit) return;
+    conn->quit = jsonrpc_peer_feed(conn->peer, data, len);
+    if (!conn->quit && opcode == WS_TEXT && len > 0 && data[len - 1] != '\n')
+        conn->quit = jsonrpc_peer_feed(conn->peer, "\n", 1);
+}
+
+static const char *content_type(const char *path) {
+    static const struct { const char *ext, *type; } types[] = {
+        {".html", "text/html; charset=utf-8"},
+        {".js", "text/javascript; charset=utf-8"},
+        {".mjs", "text/javascript; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".json", "application/json"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".ico", "image/x-icon"},
+        {".wasm", "application/wasm"},
+    };
+    const char *dot = strrchr(path, '.');
+    for (size_t i = 0; dot && i < sizeof(types) / sizeof(types[0]); i++)
+        if (strcmp(dot, types[i].ext) == 0) return types[i].type;
+    return "application/octet-stream";
+}
+
+static void respond_status(RpcConn *conn, const char *status) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+                     status, strlen(status) + 1, status);
+    conn_write_raw(conn, head, (size_t)n);
+}
+
+/* Answer a plain GET with the file of the web root at 'path' */
+static void serve_file(RpcConn *conn, const char *path) {
+    const char *root = conn->server->web_root;
+    char file[4096];
+    size_t plen = strcspn(path, "?#");
+    if (!root || path[0] != '/' || strstr(path, "..")) {
+        respond_status(conn, "404 Not Found");
+        return;
+    }
+    snprintf(file, sizeof(file), "%s%.*s%s", root, (int)plen, path,
+             path[plen - 1] == '/' ? "index.html" : "");
+
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > RPC_SERVER_FILE_MAX) {
+        if (fd != -1) close(fd);
+        respond_status(conn, "404 Not Found");
+        return;
+    }
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                     "Content-Length: %lld\r\nConnection: close\r\n\r\n",
+                     content_type(file), (long long)st.st_size);
+    conn_write_raw(conn, head, (size_t)n);
+
+    char chunk[65536];
+    ssize_t got;
+    while ((got = read(fd, chunk, sizeof(chunk))) > 0) conn_write_raw(conn, chunk, (size_t)got);
+    close(fd);
+}
+
+/* Bytes of an HTTP connection before the handshake. Returns 1 if the
+ * connection is to end once its output is written. */
+static int http_read(RpcConn *conn, const char *data, size_t len) {
+    size_t take = len < WS_REQUEST_MAX - conn->head_len ? len : WS_REQUEST_MAX - conn->head_len;
+    size_t cap = conn->head_len;
+    buf_append(&conn->head, &conn->head_len, &cap, data, take);
+
+    WsRequest req;
+    int head = ws_parse_request(conn->head, conn->head_len, &req);
+    if (head == 0) return 0;
+    if (head < 0) {
+        respond_status(conn, "400 Bad Request");
+        return 1;
+    }
+    if (!req.upgrade) {
+        serve_file(conn, req.path);
+        return 1;
+    }
+
+    char response[WS_RESPONSE_MAX];
+    conn_write_raw(conn, response, ws_handshake_response(&req, response));
+    WsCallbacks cb = { ws_message, conn_write_raw, conn };
+    conn->ws = ws_new(&req, &cb);
+
+    /* Frames sent with the request */
+    size_t rest = conn->head_len - (size_t)head;
+    int closed = rest > 0 ? ws_feed(conn->ws, conn->head + head, rest) : 0;
+    if (take < len && !closed) closed = ws_feed(conn->ws, data + take, len - take);
+    free(conn->head);
+    conn->head = NULL;
+    conn->head_len = 0;
+    return closed;
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    RpcConn *conn = stream->data;
+    RpcServer *server = conn->server;
+    if (conn->closing) return;
+
+    if (nread < 0) {
+        if (!conn->http) jsonrpc_peer_finish(conn->peer);
+        server_flush(server);
+        conn_end(conn);
+        return;
+    }
+    if (!conn->sniffed && nread > 0) {
+        size_t n = (size_t)nread < 4 ? (size_t)nread : 4;
+        conn->sniffed = 1;
+        conn->http = memcmp(buf->base, "GET ", n) == 0;
+    }
+
+    int quit;
+    if (conn->ws) {
+        quit = ws_feed(conn->ws, buf->base, (size_t)nread);
+    } else if (conn->http) {
+        quit = http_read(conn, buf->base, (size_t)nread);
+    } else {
+        quit = jsonrpc_peer_feed(conn->peer, buf->base, (size_t)nread);
+    }
+    if (conn->quit) {
+        /* Its responses go out first, in the message before the close */
+        conn_flush(conn);
+        ws_close(conn->ws, 1000);
+        quit = 1;
+    }
+    server_flush(server);
+    if (quit) {
+        conn_end(conn);
+    } else if (conn->pending > RPC_SERVER_HIGH_WATER) {
+        conn->paused = 1;
+        uv_read_stop(stream);
+    }
+}
+
+static void on_connection(uv_stream_t *listener, int status) {
+    RpcServer *server = listener->data;
+    if (status < 0) return;
+
+    RpcConn *conn = calloc(1, sizeof(*conn));
+    if (!conn) return;
+    conn->server = server;
+    if (server->is_tcp)
+        uv_tcp_init(server->loop, &conn->sock.tcp);
+    else
+        uv_pipe_init(server->loop, &conn->sock.pipe, 0);
+    conn->sock.handle.data = conn;
+    server->handles++;
+    if (uv_accept(listener, &conn->sock.stream) != 0) {
+        uv_close(&conn->sock.handle, on_conn_closed);
+        return;
+    }
+
+    JsonRpcPeerCallbacks cb = { conn_write, conn_attach, conn_changed, conn };
+    conn->entry = session_add(server, NULL);
+    conn->peer = conn->entry ? jsonrpc_peer_new(conn->entry->session, &cb) : NULL;
+    if (!conn->peer) {
+        if (conn->entry) {
+            conn->entry->clients = 1;
+            session_release(server, conn->entry);
+        }
+        uv_close(&conn->sock.handle, on_conn_closed);
+        return;
+    }
+    conn->entry->clients = 1;
+    conn->next = server->conns;
+    server->conns = conn;
+    server->clients++;
+    uv_read_start(&conn->sock.stream, on_alloc, on_read);
+}
+
+/* ======================= Server ============================================ */
+
+/* Bind 'address' ("tcp:HOST:PORT"; the prefix is gone) to the listener */
+static int bind_tcp(RpcServer *server, const char *address, char *err, size_t err_size) {
+    char host[256];
+    const char *port;
+    if (address[0] == '[') {
+        const char *end = strchr(address, ']');
+        if (!end || end[1] != ':') goto bad;
+        snprintf(host, sizeof(host), "%.*s", (int)(end - address - 1), address + 1);
+        port = end + 2;
+    } else {
+        const char *colon = strrchr(address, ':');
+        if (!colon) goto bad;
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        port = colon + 1;
+    }
+    char *end;
+    long n = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || n < 0 || n > 65535) goto bad;
+
+    struct sockaddr_storage addr;
+    int rc = strchr(host, ':') ? uv_ip6_addr(host, (int)n, (struct sockaddr_in6 *)&addr)
+                               : uv_ip4_addr(host, (int)n, (struct sockaddr_in *)&addr);
+    if (rc == 0) rc = uv_tcp_bind(&server->listener.tcp, (const struct sockaddr *)&addr, 0);
+    if (rc != 0) {
+        snprintf(err, err_size, "%s: %s", address, uv_strerror(rc));
+        return -1;
+    }
+    return 0;
+
+bad:
+    snprintf(err, err_size, "%s: expected HOST:PORT", address);
+    return -1;
+}
+
+/* Run the loop until the server's handles are closed */
+static void wait_closed(RpcServer *server) {
+    while (server->handles > 0) uv_run(server->loop, UV_RUN_ONCE);
+}
+
+RpcServer *rpc_server_start(uv_loop_t *loop, const char *address,
+                            const EditorConfig *config, char *err, size_t err_size) {
+    RpcServer *server = calloc(1, sizeof(*server));
+    if (!server) {
+        snprintf(err, err_size, "Out of memory");
+        return NULL;
+    }
+    server->loop = loop;
+    if (config) server->config = *config;
+
+    int rc;
+    if (strncmp(address, "unix:", 5) == 0) {
+        uv_pipe_init(loop, &server->listener.pipe, 0);
+        server->listener.handle.data = server;
+        server->handles++;
+        rc = uv_pipe_bind(&server->listener.pipe, address + 5);
+        if (rc != 0) snprintf(err, err_size, "%s: %s", address + 5, uv_strerror(rc));
+        else server->unix_path = strdup(address + 5);
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        server->is_tcp = 1;
+        uv_tcp_init(loop, &server->listener.tcp);
+        server->listener.handle.data = server;
+        server->handles++;
+        rc = bind_tcp(server, address + 4, err, err_size);
+    } else {
+        snprintf(err, err_size, "%s: expected unix:PATH or tcp:HOST:PORT", address);
+        free(server);
+        return NULL;
+    }
+    if (rc == 0) {
+        rc = uv_listen(&server->listener.stream, RPC_SERVER_BACKLOG, on_connection);
+        if (rc != 0) snprintf(err, err_size, "%s: %s", address, uv_strerror(rc));
+    }
+    if (rc != 0) {
+        rpc_server_close(server);
+        return NULL;
+    }
+    return server;
+}
+
+void rpc_server_close(RpcServer *server) {
+    if (!server) return;
+    while (server->conns) conn_close(server->conns);
+    uv_close(&server->listener.handle, on_handle_closed);
+    wait_closed(server);
+    while (server->sessions) {
+        server->sessions->clients = 1;
+        session_release(server, server->sessions);
+    }
+    if (server->unix_path) remove(server->unix_path);
+    free(server->unix_path);
+    free(server->web_root);
+    free(server);
+}
+
+int rpc_server_port(const RpcServer *server) {
+    if (!server->is_tcp) return -1;
+    struct sockaddr_storage addr;
+    int len = sizeof(addr);
+    if (uv_tcp_getsockname(&server->listener.tcp, (struct sockaddr *)&addr, &len) != 0)
+        return -1;
+    if (addr.ss_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+int rpc_server_clients(const RpcServer *server) {
+    return server->clients;
+}
+
+void rpc_server_set_web_root(RpcServer *server, const char *dir) {
+    free(server->web_root);
+    server->web_root = dir ? strdup(dir) : NULL;
+}
+
+static void on_stop_signal(uv_signal_t *handle, int signum) {
+    (void)signum;
+    uv_stop(handle->loop);
+}
+
+int rpc_server_run(const char *address, const EditorConfig *config) {
+    uv_loop_t *loop = uv_default_loop();
+    char err[512];
+    RpcServer *server = rpc_server_start(loop, address, config, err, sizeof(err));
+    if (!server) {
+        fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+
+    uv_signal_t sigint, sigterm;
+    uv_signal_init(loop, &sigint);
+    uv_signal_init(loop, &sigterm);
+    uv_signal_start(&sigint, on_stop_signal, SIGINT);
+    uv_signal_start(&sigterm, on_stop_signal, SIGTERM);
+
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    uv_close((uv_handle_t *)&sigint, NULL);
+    uv_close((uv_handle_t *)&sigterm, NULL);
+    rpc_server_close(server);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/* rpc_server.h - The JSON-RPC harness served over sockets
+ *
+ * One process hosts many editor sessions for many clients at once, on a
+ * libuv loop, instead of a process per client on stdin/stdout. Clients
+ * connect to a Unix domain socket or a TCP port and speak the protocol of
+ * jsonrpc.h, in the format set by jsonrpc_set_format().
+ *
+ * Each connection starts with a session of its own, freed when it
+ * closes. {"cmd": "attach", "session": "name"} moves it to the named
+ * session instead, made by the first client to attach to it and freed
+ * when the last one leaves. Clients attached to one session see each
+ * other's work: after a command that may have changed what the session
+ * shows, the others get {"event": "changed", "session": "name"}, and ask
+ * for a snapshot when they care to. Every client has its own frames.
+ *
+ * Responses are gathered per connection while its input is processed and
+ * written in one go. A client that does not read what it is sent has no
+ * more of its input read once RPC_SERVER_HIGH_WATER bytes are waiting to
+ * be written to it, until they drain below RPC_SERVER_LOW_WATER.
+ *
+ * Browsers connect to the same socket with a WebSocket (see websocket.h):
+ * its messages carry the protocol, and the responses to each read go
+ * back as one message, compressed when the browser takes it. Other GET
+ * requests are answered with the files of the web root, if one is set
+ * (rpc_server_set_web_root()): the page of the browser's client.
+ */
+
+#ifndef LOKI_RPC_SERVER_H
+#define LOKI_RPC_SERVER_H
+
+#include <stddef.h>
+#include "session.h"
+
+struct uv_loop_s;
+
+/* Bytes waiting to be written to a client past which its input waits */
+#define RPC_SERVER_HIGH_WATER (1024 * 1024)
+#define RPC_SERVER_LOW_WATER (256 * 1024)
+
+typedef struct RpcServer RpcServer;
+
+/* Listen on 'address': "unix:PATH", or "tcp:HOST:PORT" (an IPv6 HOST in
+ * brackets; PORT 0 for any free one), on 'loop'. Sessions are made with
+ * 'config' (NULL for defaults). Returns NULL with 'err' set on failure. */
+RpcServer *rpc_server_start(struct uv_loop_s *loop, const char *address,
+                            const EditorConfig *config, char *err, size_t err_size);
+
+/* Close every connection and session, and the socket. Runs the loop
+ * until the handles are closed. */
+void rpc_server_close(RpcServer *server);
+
+/* The TCP port listened on (the one picked for port 0), or -1 */
+int rpc_server_port(const RpcServer *server);
+
+/* Connections open */
+int rpc_server_clients(const RpcServer *server);
+
+/* Serve the files under 'dir' (NULL: none) to GET requests other than
+ * WebSocket handshakes, index.html for a directory */
+void rpc_server_set_web_root(RpcServer *server, const char *dir);
+
+/* Serve 'address' on the default loop until SIGINT or SIGTERM. Returns 0,
+ * or 1 if it could not listen (the reason printed to stderr). */
+int rpc_server_run(const char *address, const EditorConfig *config);
+
+#endif /* LOKI_RPC_SERVER_H */
@@ -0,0 +1,418 @@
+/* save.c - Atomic document save
+ *
+ * See save.h for an overview. Each in-flight async save is a SaveJob
+ * linked into a main-thread-only list; the worker only touches the job's
+ * own fields and the (frozen) rows, and hands results back through the
+ * async event queue.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE     /* realpath(), fsync() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <uv.h>
+#include <stdatomic.h>
+
+#include "save.h"
+#include "compress.h"
+#include "lazy.h"
+#include "task_pool.h"
+#include "reload.h"
+#include "symbols.h"
+#include "finder.h"
+#include "undo.h"
+#include "autocmd.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Iovecs per writev() call; IOV_MAX can be huge, keep the stack bounded */
+#define SAVE_IOV_BATCH (IOV_MAX < 1024 ? IOV_MAX : 1024)
+
+/* Number of progress reports over the course of one save */
+#define SAVE_PROGRESS_STEPS 20
+
+/* Saves smaller than this are not worth a progress message */
+#define SAVE_PROGRESS_MIN_BYTES (4 * 1024 * 1024)
+
+/* Mode for a newly created file */
+#define SAVE_DEFAULT_MODE 0644
+
+enum { SAVE_EVENT_PROGRESS, SAVE_EVENT_DONE };
+
+typedef struct SaveJob {
+    int id;
+    editor_ctx_t *ctx;
+    char *path;               /* Target as given (for messages) */
+    Task *task;
+    long long result;         /* Bytes written, or -1 */
+    int err;                  /* errno on failure */
+    atomic_int done;
+    atomic_int joining;       /* finish_job() waits: no event needed */
+    struct SaveJob *next;
+} SaveJob;
+
+static SaveJob *save_jobs = NULL;
+static int save_next_id = 1;
+
+/* ============================ Writing rows ============================== */
+
+/* writev() the whole iovec array, resuming after short writes. */
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/* Spans gathered for the next writev() call. */
+typedef struct SaveBatch {
+    int fd;
+    struct iovec iov[SAVE_IOV_BATCH];
+    int cnt;
+    size_t written, total, next_report;
+    save_progress_fn progress;
+    void *arg;
+    CompressWriter *writer;   /* Compressing the spans instead, or NULL */
+} SaveBatch;
+
+static int flush_batch(SaveBatch *batch) {
+    if (writev_all(batch->fd, batch->iov, batch->cnt) == -1) return -1;
+    for (int i = 0; i < batch->cnt; i++) batch->written += batch->iov[i].iov_len;
+    batch->cnt = 0;
+    if (batch->progress && batch->written >= batch->next_report &&
+        batch->written < batch->total) {
+        batch->progress(batch->written, batch->total, batch->arg);
+        batch->next_report = batch->written + batch->total / SAVE_PROGRESS_STEPS;
+    }
+    return 0;
+}
+
+/* editor_model_export() callback: queue one span, writing full batches. */
+static int batch_span(const char *data, size_t len, void *arg) {
+    SaveBatch *batch = arg;
+    batch->iov[batch->cnt].iov_base = (void *)data;
+    batch->iov[batch->cnt].iov_len = len;
+    if (++batch->cnt == SAVE_IOV_BATCH) return flush_batch(batch);
+    return 0;
+}
+
+/* Stream the rows to fd straight from the row buffers. */
+static int write_model(int fd, const EditorModel *model, size_t total,
+                       save_progress_fn progress, void *arg) {
+    SaveBatch batch;
+    batch.fd = fd;
+    batch.cnt = 0;
+    batch.writer = NULL;
+    batch.written = 0;
+    batch.total = total;
+    batch.next_report = total / SAVE_PROGRESS_STEPS;
+    batch.progress = progress;
+    batch.arg = arg;
+
+    if (editor_model_export(model, EXPORT_NEWLINES, batch_span, &batch) != 0)
+        return -1;
+    return batch.cnt > 0 ? flush_batch(&batch) : 0;
+}
+
+/* editor_model_export() callback: compress one span. */
+static int compress_span(const char *data, size_t len, void *arg) {
+    SaveBatch *batch = arg;
+    if (compress_writer_write(batch->writer, data, len) == -1) return -1;
+    batch->written += len;
+    if (batch->progress && batch->written >= batch->next_report &&
+        batch->written < batch->total) {
+        batch->progress(batch->written, batch->total, batch->arg);
+        batch->next_report = batch->written + batch->total / SAVE_PROGRESS_STEPS;
+    }
+    return 0;
+}
+
+/* Stream the rows to fd through a compressor. Returns the bytes written,
+ * or -1. */
+static long long write_model_compressed(int fd, const EditorModel *model,
+                                        CompressFormat format, size_t total,
+                                        save_progress_fn progress, void *arg) {
+    SaveBatch batch;
+    batch.fd = fd;
+    batch.cnt = 0;
+    batch.writer = compress_writer_open(format, fd);
+    if (!batch.writer) return -1;
+    batch.written = 0;
+    batch.total = total;
+    batch.next_report = total / SAVE_PROGRESS_STEPS;
+    batch.progress = progress;
+    batch.arg = arg;
+
+    if (editor_model_export(model, EXPORT_NEWLINES, compress_span, &batch) != 0) {
+        int saved = errno;
+        compress_writer_close(batch.writer);
+        errno = saved;
+        return -1;
+    }
+    return compress_writer_close(batch.writer);
+}
+
+/* Create a temporary file in the directory of 'target'. */
+static int open_temp_beside(const char *target, char **tmp_path) {
+    size_t len = strlen(target);
+    char *tmp = malloc(len + sizeof(".loki-XXXXXX"));
+    if (!tmp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmp, target, len);
+    memcpy(tmp + len, ".loki-XXXXXX", sizeof(".loki-XXXXXX"));
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        int saved = errno;
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    *tmp_path = tmp;
+    return fd;
+}
+
+/* fsync the directory holding 'path' so the rename itself is durable.
+ * Best effort: some filesystems refuse to open or sync directories. */
+static void sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, (size_t)(slash - path) + (slash == path))
+                      : strdup(".");
+    if (!dir) return;
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+long long save_model(const EditorModel *model, const char *path,
+                     save_progress_fn progress, void *arg) {
+    size_t total = editor_model_export_size(model, EXPORT_NEWLINES);
+
+    /* Write through symlinks instead of replacing them. */
+    char *target = realpath(path, NULL);
+    if (!target) {
+        if (errno != ENOENT) return -1;
+        target = strdup(path);
+        if (!target) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    struct stat st;
+    mode_t mode = SAVE_DEFAULT_MODE;
+    if (stat(target, &st) == 0) mode = st.st_mode & 07777;
+
+    /* Named .gz or .zst: compressed as it is written */
+    CompressFormat format = compress_format_for_path(target);
+    if (!compress_supported(format)) {
+        free(target);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    char *tmp = NULL;
+    int fd = open_temp_beside(target, &tmp);
+    if (fd == -1) goto fail;
+
+    long long written = (long long)total;
+    if (format != COMPRESS_NONE)
+        written = write_model_compressed(fd, model, format, total, progress, arg);
+    else if (write_model(fd, model, total, progress, arg) == -1)
+        written = -1;
+    if (fchmod(fd, mode) == -1 || written == -1 || fsync(fd) == -1) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        goto fail;
+    }
+    if (close(fd) == -1 || rename(tmp, target) == -1) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        goto fail;
+    }
+    sync_parent_dir(target);
+
+    free(tmp);
+    free(target);
+    return written;
+
+fail:
+    {
+        int saved = errno;
+        free(tmp);
+        free(target);
+        errno = saved;
+    }
+    return -1;
+}
+
+/* ============================ Async saves =============================== */
+
+static void push_save_event(SaveJob *job, int kind, double fraction) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SAVE_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+    ev.data.user.i64[1] = kind;
+    ev.data.user.f64[0] = fraction;
+
+    if (kind == SAVE_EVENT_PROGRESS) {
+        /* Only the latest progress of a save is shown */
+        ev.coalesce_key = (uint64_t)job->id;
+        async_queue_push(NULL, &ev);  /* Dropped if the queue is full */
+        return;
+    }
+    /* Completion must not be lost; wait for room in the queue, unless
+     * finish_job() is waiting for us: then the main thread isn't draining
+     * it, and reports the result itself */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&job->joining)) return;
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void save_worker_progress(size_t written, size_t total, void *arg) {
+    SaveJob *job = arg;
+    if (total < SAVE_PROGRESS_MIN_BYTES) return;
+    push_save_event(job, SAVE_EVENT_PROGRESS, (double)written / (double)total);
+}
+
+static void save_worker(void *arg) {
+    SaveJob *job = arg;
+    job->result = save_model(&job->ctx->model, job->path,
+                             save_worker_progress, job);
+    job->err = job->result < 0 ? errno : 0;
+    atomic_store(&job->done, 1);
+    /* Run by finish_job() itself, on the thread draining the queue */
+    if (!atomic_load(&job->joining)) push_save_event(job, SAVE_EVENT_DONE, 1.0);
+}
+
+/* Wait for a job's task, report its result and forget it. Returns 0 if
+ * the file was written, else -1. */
+static int finish_job(SaveJob *job) {
+    atomic_store(&job->joining, 1);
+    task_wait(job->task);
+
+    SaveJob **pp = &save_jobs;
+    while (*pp != job) pp = &(*pp)->next;
+    *pp = job->next;
+
+    editor_ctx_t *ctx = job->ctx;
+    ctx->model.save_job = NULL;
+    if (job->result >= 0) {
+        ctx->model.dirty = 0;
+        undo_history_saved(ctx);
+        reload_watch(ctx);
+        symbols_note_file(ctx->model.filename);
+        finder_note_file(ctx->model.filename);
+        editor_set_status_msg(ctx, "%lld bytes written on disk", job->result);
+    } else {
+        editor_set_status_msg(ctx, "Can't save! I/O error: %s",
+                              strerror(job->err));
+    }
+    int ret = job->result >= 0 ? 0 : -1;
+    free(job->path);
+    free(job);
+    return ret;
+}
+
+static void save_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    int id = (int)event->data.user.i64[0];
+    SaveJob *job = save_jobs;
+    while (job && job->id != id) job = job->next;
+    if (!job) return;  /* Already finished by editor_save_wait() */
+
+    if (event->data.user.i64[1] == SAVE_EVENT_DONE) {
+        /* BufWrite runs here, not in editor_save_wait() mid-edit */
+        editor_ctx_t *ctx = job->ctx;
+        if (finish_job(job) == 0) autocmd_fire(ctx, AUTOCMD_BUF_WRITE);
+    } else if (!atomic_load(&job->done)) {
+        editor_set_status_msg(job->ctx, "Saving \"%s\"... %d%%", job->path,
+                              (int)(event->data.user.f64[0] * 100));
+    }
+}
+
+void editor_save_wait(EditorModel *model) {
+    if (model->save_job == NULL) return;
+    finish_job(model->save_job);
+}
+
+int editor_save_async(editor_ctx_t *ctx) {
+    if (async_queue_global() == NULL) return editor_save(ctx);
+
+    if (ctx->model.filename == NULL) {
+        editor_set_status_msg(ctx, "No file name (use :w <filename> to save)");
+        return -1;
+    }
+    if (lazy_is_hex(&ctx->model)) return lazy_save(ctx);
+    if (editor_refuse_edit(ctx)) return -1;
+
+    /* One save per document at a time. */
+    editor_save_wait(&ctx->model);
+
+    SaveJob *job = calloc(1, sizeof(*job));
+    if (job) job->path = strdup(ctx->model.filename);
+    if (!job || !job->path) {
+        free(job);
+        editor_set_status_msg(ctx, "Can't save! Out of memory");
+        return -1;
+    }
+    job->id = save_next_id++;
+    job->ctx = ctx;
+    atomic_init(&job->done, 0);
+    atomic_init(&job->joining, 0);
+
+    if (async_queue_get_handler(NULL, SAVE_ASYNC_EVENT) != save_event_handler) {
+        async_queue_set_handler(NULL, SAVE_ASYNC_EVENT, save_event_handler);
+        async_event_set_type_name(SAVE_ASYNC_EVENT, "save");
+    }
+
+    job->next = save_jobs;
+    save_jobs = job;
+    ctx->model.save_job = job;
+    job->task = task_submit(save_worker, job, TASK_PRIORITY_NORMAL, NULL);
+    if (job->task == NULL) {
+        save_jobs = job->next;
+        ctx->model.save_job = NULL;
+        free(job->path);
+        free(job);
+        return editor_save(ctx);
+    }
+    editor_set_status_msg(ctx, "Saving \"%s\"...", ctx->model.filename);
+    return 0;
+}
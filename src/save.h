@@ -0,0 +1,48 @@
+/* save.h - Atomic document save
+ *
+ * Saving writes the rows straight from the model with writev(), in
+ * batches of up to IOV_MAX spans from editor_model_export(), so no copy
+ * of the whole document is ever built. The data goes to a temporary file next to the
+ * target, which is fsync()ed and then rename()d over it, so a crash
+ * mid-save leaves either the old or the new file, never a truncated one.
+ * A name ending in .gz or .zst is written compressed (see compress.h),
+ * the spans streamed through the compressor instead.
+ *
+ * editor_save() runs the pipeline on the calling thread. editor_save_async()
+ * runs it on a worker thread and reports progress and completion on the
+ * status line through the async event queue. While a save is in flight the
+ * document is read by the worker, so the row-editing primitives in core.c
+ * call editor_save_wait() first; viewing and moving around stay live.
+ */
+
+#ifndef LOKI_SAVE_H
+#define LOKI_SAVE_H
+
+#include <stddef.h>
+#include "internal.h"
+#include "async_queue.h"
+
+/* Async event carrying save progress/completion (data.user.i64[0] = job id) */
+#define SAVE_ASYNC_EVENT ASYNC_EVENT_USER
+
+/* Progress callback: 'written' of 'total' bytes are on disk. */
+typedef void (*save_progress_fn)(size_t written, size_t total, void *arg);
+
+/* Write the model's rows, each followed by '\n', to 'path' atomically,
+ * compressed if its name says so. Symlinks are followed so the link itself
+ * is preserved. 'progress' may be NULL. Returns the number of bytes
+ * written, or -1 with errno set (ENOTSUP for a compression not built in). */
+long long save_model(const EditorModel *model, const char *path,
+                     save_progress_fn progress, void *arg);
+
+/* Save the buffer on a worker thread. Falls back to a synchronous
+ * editor_save() when the async event queue is not running (tests, the
+ * headless session API). Returns 0 if the save was started or done,
+ * -1 on error (status message set). */
+int editor_save_async(editor_ctx_t *ctx);
+
+/* Block until any save in flight for 'model' has finished and its result
+ * has been reported. Cheap no-op when none is running. */
+void editor_save_wait(EditorModel *model);
+
+#endif /* LOKI_SAVE_H */
@@ -5,11 +5,15 @@
  * in real-time. Users can navigate between matches with arrow keys.
  *
  * Features:
- * - Incremental search: updates as you type
+ * - Incremental search: updates as you type; a longer query only checks
+ *   where the shorter one matched (see search_cache_lookup())
  * - Forward/backward navigation: arrow keys move between matches
  * - Visual highlighting: matches shown with HL_MATCH color
  * - Wrapping: search wraps around at beginning/end of file
  * - Restore cursor: ESC returns to original position
+ * - Long buffers: only rows the trigram index lists are searched (see
+ *   search_index.h)
+ * - Case: :set ignorecase and smartcase (see search_ignores_case())
  *
  * Keybindings:
  * - ESC: Cancel search, restore original cursor position
@@ -17,90 +21,792 @@
  * - Arrow Up/Left: Search backward (previous match)
  * - Arrow Down/Right: Search forward (next match)
  * - Backspace/Delete: Remove character from query
+ * - Ctrl-R: Toggle between plain text and regex (see regexp.h) queries
  * - Printable chars: Add to search query
  */
 
 #include "search.h"
+#include "search_index.h"
 #include "internal.h"
 #include "terminal.h"
+#include "syntax.h"
+#include "task_pool.h"
+#include "decor.h"
+#include "lazy.h"
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <uv.h>
+
+/* ======================= Compiled Patterns ================================= */
+/* Short needles: a block of 16 start positions compares its bytes with the
+ * needle's first byte and the bytes len-1 further on with its last byte;
+ * only positions where both agree are checked with memcmp(). Without SSE2
+ * memchr() finds the first byte. Longer needles use Horspool: the byte
+ * under the window's end says how far the needle can move.
+ *
+ * Ignoring case, needles of any length take the first path, with the
+ * bytes compared folded in the vector: a letter matches either case once
+ * 0x20 is or-ed in, and the first byte of a UTF-8 character once 0x01 is
+ * (a letter's other case starts with a byte that differs at most there).
+ * Positions that pass are compared a character at a time, ASCII without
+ * decoding. Nothing is copied or lowered in advance. */
+
+#if defined(__GNUC__) && !defined(SEARCH_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SEARCH_USE_SSE2 1
+#endif
+
+void search_pattern_init(SearchPattern *pat, const char *needle, int len) {
+    search_pattern_init_icase(pat, needle, len, 0);
+}
+
+static int ascii_letter(unsigned char c) {
+    return (unsigned)((c | 0x20) - 'a') < 26u;
+}
+
+static unsigned char fold_ascii(unsigned char c) {
+    return (unsigned)(c - 'A') < 26u ? (unsigned char)(c | 0x20) : c;
+}
+
+/* Lower case of code point 'cp' (0x80-0x7ff), for the scripts in search.h;
+ * other code points are themselves. */
+static int fold_cp(int cp) {
+    if (cp >= 0xc0 && cp <= 0xde && cp != 0xd7) return cp + 0x20;
+    if (cp >= 0x100 && cp <= 0x17f) {
+        /* Latin Extended-A: upper then lower, paired from even or odd */
+        if ((cp <= 0x12f) || (cp >= 0x132 && cp <= 0x137) ||
+            (cp >= 0x14a && cp <= 0x177))
+            return cp | 1;
+        if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17e))
+            return (cp & 1) ? cp + 1 : cp;
+        return cp;
+    }
+    if (cp >= 0x386 && cp <= 0x3ab) {
+        if (cp == 0x386) return 0x3ac;
+        if (cp >= 0x388 && cp <= 0x38a) return cp + 37;
+        if (cp == 0x38c) return 0x3cc;
+        if (cp == 0x38e || cp == 0x38f) return cp + 63;
+        if (cp >= 0x391 && cp != 0x3a2) return cp + 0x20;
+        return cp;
+    }
+    if (cp == 0x3c2) return 0x3c3;                      /* Final sigma */
+    if (cp >= 0x400 && cp <= 0x40f) return cp + 0x50;
+    if (cp >= 0x410 && cp <= 0x42f) return cp + 0x20;
+    return cp;
+}
+
+/* The two-byte UTF-8 sequence at 'p' as a code point, or -1 */
+static int utf8_pair(const unsigned char *p) {
+    if (p[0] < 0xc2 || p[0] > 0xdf || (p[1] & 0xc0) != 0x80) return -1;
+    return ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+}
+
+/* Whether the 'm' bytes at 'hay' match the needle 'n', ignoring case */
+static int fold_equal(const unsigned char *hay, const unsigned char *n,
+                      size_t m) {
+    size_t i = 0;
+    while (i < m) {
+        unsigned char a = hay[i], b = n[i];
+        if ((a | b) < 0x80) {
+            if (a != b && fold_ascii(a) != fold_ascii(b)) return 0;
+            i++;
+            continue;
+        }
+        if (i + 1 < m) {
+            int ca = utf8_pair(hay + i), cb = utf8_pair(n + i);
+            if (ca >= 0 && cb >= 0) {
+                if (ca != cb && fold_cp(ca) != fold_cp(cb)) return 0;
+                i += 2;
+                continue;
+            }
+        }
+        if (a != b) return 0;
+        i++;
+    }
+    return 1;
+}
+
+void search_pattern_init_icase(SearchPattern *pat, const char *needle,
+                               int len, int icase) {
+    pat->needle = needle;
+    pat->len = len;
+    pat->icase = icase;
+    pat->ascii = 1;
+    for (int i = 0; i < len; i++)
+        if ((unsigned char)needle[i] >= 0x80) pat->ascii = 0;
+
+    if (icase) {
+        /* The first and last bytes that start a character */
+        pat->nanchor = 0;
+        for (int i = 0; i < len; i++) {
+            unsigned char c = (unsigned char)needle[i];
+            if ((c & 0xc0) == 0x80) continue;
+            int k = pat->nanchor < 2 ? pat->nanchor++ : 1;
+            pat->anchor[k] = i;
+            pat->anchor_mask[k] = ascii_letter(c) ? 0x20 : c >= 0xc0 ? 0x01 : 0;
+            pat->anchor_val[k] = c | pat->anchor_mask[k];
+        }
+        if (pat->nanchor == 1) {
+            pat->anchor[1] = pat->anchor[0];
+            pat->anchor_mask[1] = pat->anchor_mask[0];
+            pat->anchor_val[1] = pat->anchor_val[0];
+        }
+    }
+    if (len < SEARCH_SKIP_MIN || icase) return;
+
+    for (int c = 0; c < 256; c++) pat->skip[c] = len;
+    for (int i = 0; i < len - 1; i++)
+        pat->skip[(unsigned char)needle[i]] = len - 1 - i;
+}
+
+int search_pattern_equal(const SearchPattern *pat, const char *s) {
+    if (!pat->icase) return memcmp(s, pat->needle, (size_t)pat->len) == 0;
+    return fold_equal((const unsigned char *)s,
+                      (const unsigned char *)pat->needle, (size_t)pat->len);
+}
+int search_ignores_case(const editor_ctx_t *ctx, const char *query, int len,
+                        int regex) {
+    if (!ctx->view.ignore_case) return 0;
+    if (!ctx->view.smart_case) return 1;
+    const unsigned char *q = (const unsigned char *)query;
+    for (int i = 0; i < len; i++) {
+        if (regex && q[i] == '\\') {
+            i++;              /* \W, \S, \D are not upper case */
+            continue;
+        }
+        if (q[i] >= 'A' && q[i] <= 'Z') return 0;
+        if (i + 1 < len) {
+            int cp = utf8_pair(q + i);
+            if (cp >= 0 && fold_cp(cp) != cp) return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *find_filtered(const SearchPattern *pat, const char *hay,
+                                 size_t n) {
+    const char *needle = pat->needle;
+    size_t m = (size_t)pat->len;
+    size_t end = n - m;       /* Last start position */
+    size_t i = 0;
+
+#ifdef SEARCH_USE_SSE2
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m-1]);
+    for (; i + 16 <= end + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(hay + at, needle, m) == 0) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= end) {
+        const char *p = memchr(hay + i, needle[0], end - i + 1);
+        if (!p) return NULL;
+        if (p[m-1] == needle[m-1] && memcmp(p, needle, m) == 0) return p;
+        i = (size_t)(p - hay) + 1;
+    }
+    return NULL;
+}
+
+static const char *find_skipping(const SearchPattern *pat, const char *hay,
+                                 size_t n) {
+    const char *needle = pat->needle;
+    size_t m = (size_t)pat->len;
+    unsigned char last = (unsigned char)needle[m-1];
+
+    for (size_t i = 0; i + m <= n; ) {
+        unsigned char c = (unsigned char)hay[i + m - 1];
+        if (c == last && memcmp(hay + i, needle, m - 1) == 0) return hay + i;
+        i += (size_t)pat->skip[c];
+    }
+    return NULL;
+}
+
+/* find_filtered() ignoring case: the anchor bytes, folded, filter */
+static const char *find_folded(const SearchPattern *pat, const char *hay,
+                               size_t n) {
+    const unsigned char *h = (const unsigned char *)hay;
+    const unsigned char *needle = (const unsigned char *)pat->needle;
+    size_t m = (size_t)pat->len;
+    size_t end = n - m;       /* Last start position */
+    size_t i = 0;
+
+    if (pat->nanchor == 0) {
+        for (; i <= end; i++)
+            if (fold_equal(h + i, needle, m)) return hay + i;
+        return NULL;
+    }
+    size_t a0 = (size_t)pat->anchor[0], a1 = (size_t)pat->anchor[1];
+    unsigned char m0 = pat->anchor_mask[0], v0 = pat->anchor_val[0];
+    unsigned char m1 = pat->anchor_mask[1], v1 = pat->anchor_val[1];
+
+#ifdef SEARCH_USE_SSE2
+    const __m128i mask0 = _mm_set1_epi8((char)m0), val0 = _mm_set1_epi8((char)v0);
+    const __m128i mask1 = _mm_set1_epi8((char)m1), val1 = _mm_set1_epi8((char)v1);
+    for (; i + 16 <= end + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(h + i + a0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + i + a1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(a, mask0), val0),
+            _mm_cmpeq_epi8(_mm_or_si128(b, mask1), val1)));
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (fold_equal(h + at, needle, m)) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= end; i++) {
+        if ((h[i + a0] | m0) == v0 && (h[i + a1] | m1) == v1 &&
+            fold_equal(h + i, needle, m))
+            return hay + i;
+    }
+    return NULL;
+}
+
+const char *search_pattern_find(const SearchPattern *pat, const char *hay,
+                                size_t len) {
+    if (pat->len <= 0) return hay;
+    if ((size_t)pat->len > len) return NULL;
+    if (pat->icase) return find_folded(pat, hay, len);
+    if (pat->len < SEARCH_SKIP_MIN) return find_filtered(pat, hay, len);
+    return find_skipping(pat, hay, len);
+}
+
+int search_render_col(t_erow *row, int off) {
+    /* Every TAB renders at least one column: equal sizes means none
+     * widened, so columns are offsets */
+    if (!row->colindex && row->rsize == row->size) return off;
+    return editor_row_cx_to_rx(row, off);
+}
+
+int search_row_find(const SearchPattern *pat, t_erow *row) {
+    const char *match = search_pattern_find(pat, row->chars, (size_t)row->size);
+    if (!match) return -1;
+    return search_render_col(row, (int)(match - row->chars));
+}
+
+/* ======================= Match Sets ======================================== */
+
+void search_cache_init(SearchCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void set_drop(SearchSet *set) {
+    free(set->m);
+    set->m = NULL;
+    set->n = set->cap = 0;
+    set->state = 0;
+}
+
+void search_cache_free(SearchCache *cache) {
+    for (int k = 0; k <= KILO_QUERY_LEN; k++) set_drop(&cache->set[k]);
+    cache->qlen = 0;
+    regexp_free(cache->re);
+    cache->re = NULL;
+}
+
+/* Returns 0, or -1 once the set is over SEARCH_SET_MAX */
+static int set_add(SearchSet *set, int row, int off) {
+    if (set->n == set->cap) {
+        if (set->cap >= SEARCH_SET_MAX) return -1;
+        int cap = set->cap ? set->cap * 2 : 64;
+        SearchMatch *m = realloc(set->m, sizeof(SearchMatch) * (size_t)cap);
+        if (m == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        set->m = m;
+        set->cap = cap;
+    }
+    set->m[set->n].row = row;
+    set->m[set->n].off = off;
+    set->n++;
+    return 0;
+}
+
+void search_regexp_rows(editor_ctx_t *ctx, const Regexp *re,
+                        SearchRanges *rows) {
+    const char *lit;
+    int len = regexp_required(re, &lit);
+    search_index_lookup(&ctx->model, lit, len, rows);
+}
+
+void search_pattern_rows(editor_ctx_t *ctx, const SearchPattern *pat,
+                         SearchRanges *rows) {
+    const char *key = pat->needle;
+    int len = pat->len;
+    if (pat->icase && !pat->ascii) {
+        /* The index folds ASCII only: look up the longest ASCII run */
+        len = 0;
+        for (int i = 0, run = 0; i < pat->len; i++) {
+            run = (unsigned char)pat->needle[i] < 0x80 ? run + 1 : 0;
+            if (run > len) {
+                len = run;
+                key = pat->needle + i + 1 - run;
+            }
+        }
+    }
+    search_index_lookup(&ctx->model, key, len, rows);
+}
+
+/* Every match in the buffer, overlapping ones included */
+static void set_scan(SearchSet *set, editor_ctx_t *ctx, const char *query,
+                     int len, int icase) {
+    SearchPattern pat;
+    search_pattern_init_icase(&pat, query, len, icase);
+    SearchRanges rows = {NULL, 0, 0};
+    search_pattern_rows(ctx, &pat, &rows);
+
+    set->state = 1;
+    set->icase = icase;
+    for (int i = 0; i < rows.n && set->state == 1; i++) {
+        for (int r = rows.r[i].first; r <= rows.r[i].last; r++) {
+            t_erow *row = editor_row(ctx, r);
+            const char *p = row->chars;
+            size_t left = (size_t)row->size;
+            const char *match;
+            while ((match = search_pattern_find(&pat, p, left)) != NULL) {
+                if (set_add(set, r, (int)(match - row->chars)) != 0) {
+                    set_drop(set);
+                    set->state = -1;
+                    break;
+                }
+                left -= (size_t)(match - p) + 1;
+                p = match + 1;
+            }
+            if (set->state != 1) break;
+        }
+    }
+    search_ranges_free(&rows);
+}
+
+/* The matches of 'query' among those of a prefix of it. Matches ignoring
+ * case include the others, so 'from' may ignore case when 'query' does
+ * not, but not the other way round. */
+static void set_refine(SearchSet *set, const SearchSet *from,
+                       editor_ctx_t *ctx, const char *query, int len,
+                       int icase) {
+    SearchPattern pat;
+    search_pattern_init_icase(&pat, query, len, icase);
+    for (int i = 0; i < from->n; i++) {
+        t_erow *row = editor_row(ctx, from->m[i].row);
+        int off = from->m[i].off;
+        if (off + len <= row->size &&
+            search_pattern_equal(&pat, row->chars + off))
+            set_add(set, from->m[i].row, off);  /* Never more than 'from' */
+    }
+    set->state = 1;
+    set->icase = icase;
+}
+
+const SearchSet *search_cache_lookup(SearchCache *cache, editor_ctx_t *ctx,
+                                     const char *query, int len) {
+    if (len <= 0 || len > KILO_QUERY_LEN) return NULL;
+    int icase = search_ignores_case(ctx, query, len, 0);
+
+    /* Keep the sets of the prefix this query shares with the cached one;
+     * after a backspace that is all of it, and the longer sets stay for
+     * when the same characters are typed again. */
+    int common = 0;
+    if (cache->damage_gen == ctx->model.damage_gen) {
+        while (common < len && common < cache->qlen &&
+               cache->query[common] == query[common]) common++;
+    }
+    if (common < len) {
+        for (int k = common + 1; k <= KILO_QUERY_LEN; k++) {
+            if (cache->set[k].state) set_drop(&cache->set[k]);
+        }
+        memcpy(cache->query, query, (size_t)len);
+        cache->qlen = len;
+    }
+    cache->damage_gen = ctx->model.damage_gen;
+
+    /* A set built with the case setting since changed is of no use */
+    SearchSet *set = &cache->set[len];
+    if (set->state && set->icase != icase) set_drop(set);
+    if (set->state == 0) {
+        int k = len - 1;
+        while (k > 0 && (cache->set[k].state == 0 ||
+                         (icase && !cache->set[k].icase))) k--;
+        if (k > 0 && cache->set[k].state == 1)
+            set_refine(set, &cache->set[k], ctx, query, len, icase);
+        else
+            set_scan(set, ctx, query, len, icase);
+    }
+    return set->state == 1 ? set : NULL;
+}
+
+Regexp *search_cache_regexp(SearchCache *cache, const char *query, int len,
+                            int flags, const char **error) {
+    *error = NULL;
+    if (cache->re && cache->re_len == len && cache->re_flags == flags &&
+        memcmp(cache->re_query, query, (size_t)len) == 0)
+        return cache->re;
+
+    regexp_free(cache->re);
+    cache->re = regexp_compile(query, flags, error);
+    memcpy(cache->re_query, query, (size_t)len);
+    cache->re_query[len] = '\0';
+    cache->re_len = cache->re ? len : -1;
+    cache->re_flags = flags;
+    return cache->re;
+}
+
+/* Index of the first match in row 'row' or after it */
+static int set_lower_bound(const SearchSet *set, int row) {
+    int lo = 0, hi = set->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (set->m[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int search_set_next(const SearchSet *set, int from_row, int direction) {
+    if (set->n == 0) return -1;
+    if (direction > 0) {
+        int i = set_lower_bound(set, from_row + 1);
+        return i < set->n ? i : 0;
+    }
+    int i = set_lower_bound(set, from_row);
+    int row = i > 0 ? set->m[i-1].row : set->m[set->n-1].row;
+    return set_lower_bound(set, row);
+}
+
+/* ======================= Match Counting ==================================== */
+
+struct SearchCount {
+    editor_ctx_t *ctx;
+    char query[KILO_QUERY_LEN+1];
+    int len;
+    int regex;
+    int re_flags;             /* REGEXP_ICASE when ignoring case */
+    SearchPattern pat;
+    Regexp *re;               /* Main thread's copy, for search_count_index() */
+    SearchRanges rows;        /* Rows that can match (see search_index.h) */
+    int nrows, nchunks;
+    int *chunk_count;         /* Matches in each chunk of rows */
+    uv_mutex_t lock;          /* Guards the fields below */
+    int next_chunk;           /* Next chunk to hand out */
+    int chunks_done;
+    int cancel;
+    int ntasks;
+    Task *tasks[SEARCH_COUNT_MAX_WORKERS];
+    TaskToken token;          /* Cancels the tasks not started when freed */
+};
+
+/* Matches in 'row' starting before offset 'limit'. 're' is NULL for plain
+ * queries. Matches do not overlap; an empty one skips a character. */
+static int count_row(const SearchCount *sc, Regexp *re, const t_erow *row,
+                     int limit) {
+    int n = 0, i = 0;
+    if (limit > row->size) limit = row->size + 1;
+
+    if (re) {
+        int start, end;
+        while (i <= row->size &&
+               regexp_search(re, row->chars, row->size, i, &start, &end) &&
+               start < limit) {
+            n++;
+            i = end > start ? end : end + 1;
+        }
+        return n;
+    }
+    const char *match;
+    while (i < row->size &&
+           (match = search_pattern_find(&sc->pat, row->chars + i,
+                                        (size_t)(row->size - i))) != NULL) {
+        int off = (int)(match - row->chars);
+        if (off >= limit) break;
+        n++;
+        i = off + sc->len;
+    }
+    return n;
+}
+
+/* Matches in rows first..last-1 */
+static int count_rows(const SearchCount *sc, Regexp *re, int first, int last) {
+    int n = 0;
+    for (int i = search_ranges_find(&sc->rows, first);
+         i < sc->rows.n && sc->rows.r[i].first < last; i++) {
+        int from = sc->rows.r[i].first > first ? sc->rows.r[i].first : first;
+        int to = sc->rows.r[i].last < last - 1 ? sc->rows.r[i].last : last - 1;
+        for (int r = from; r <= to; r++)
+            n += count_row(sc, re, &sc->ctx->model.row[r], INT_MAX);
+    }
+    return n;
+}
+
+static void count_worker(void *arg) {
+    SearchCount *sc = arg;
+    const char *error;
+    /* The DFA fills in as it runs, so each thread has its own */
+    Regexp *re = sc->regex ? regexp_compile(sc->query, sc->re_flags, &error)
+                           : NULL;
+
+    for (;;) {
+        uv_mutex_lock(&sc->lock);
+        int chunk = sc->cancel ? sc->nchunks : sc->next_chunk++;
+        uv_mutex_unlock(&sc->lock);
+        if (chunk >= sc->nchunks) break;
+
+        int first = chunk * SEARCH_COUNT_CHUNK_ROWS;
+        int last = first + SEARCH_COUNT_CHUNK_ROWS;
+        if (last > sc->nrows) last = sc->nrows;
+        int n = count_rows(sc, re, first, last);
+
+        uv_mutex_lock(&sc->lock);
+        sc->chunk_count[chunk] = n;
+        sc->chunks_done++;
+        uv_mutex_unlock(&sc->lock);
+    }
+    regexp_free(re);
+}
+
+SearchCount *search_count_start(editor_ctx_t *ctx, const char *query,
+                                int len, int regex) {
+    if (len <= 0 || len > KILO_QUERY_LEN) return NULL;
+
+    SearchCount *sc = calloc(1, sizeof(SearchCount));
+    if (sc == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sc->ctx = ctx;
+    memcpy(sc->query, query, (size_t)len);
+    sc->len = len;
+    sc->regex = regex;
+    int icase = search_ignores_case(ctx, query, len, regex);
+    if (regex) {
+        const char *error;
+        sc->re_flags = icase ? REGEXP_ICASE : 0;
+        sc->re = regexp_compile(sc->query, sc->re_flags, &error);
+        if (!sc->re) {
+            free(sc);
+            return NULL;
+        }
+        search_regexp_rows(ctx, sc->re, &sc->rows);
+    } else {
+        search_pattern_init_icase(&sc->pat, sc->query, len, icase);
+        search_pattern_rows(ctx, &sc->pat, &sc->rows);
+    }
+    sc->nrows = editor_numrows(ctx);
+    sc->nchunks = (sc->nrows + SEARCH_COUNT_CHUNK_ROWS - 1) / SEARCH_COUNT_CHUNK_ROWS;
+    sc->chunk_count = calloc((size_t)(sc->nchunks ? sc->nchunks : 1), sizeof(int));
+    if (sc->chunk_count == NULL || uv_mutex_init(&sc->lock) != 0) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    if (sc->nrows < SEARCH_COUNT_PARALLEL_ROWS) {
+        count_worker(sc);
+        return sc;
+    }
+
+    int nworkers = task_pool_threads();
+    if (nworkers > sc->nchunks) nworkers = sc->nchunks;
+    if (nworkers > SEARCH_COUNT_MAX_WORKERS) nworkers = SEARCH_COUNT_MAX_WORKERS;
+    task_token_init(&sc->token);
+    while (sc->ntasks < nworkers &&
+           (sc->tasks[sc->ntasks] = task_submit(count_worker, sc, TASK_PRIORITY_NORMAL,
+                                                &sc->token)))
+        sc->ntasks++;
+    if (sc->ntasks == 0) count_worker(sc);  /* No threads: count here */
+    return sc;
+}
+
+int search_count_total(SearchCount *sc) {
+    uv_mutex_lock(&sc->lock);
+    int done = sc->chunks_done == sc->nchunks;
+    uv_mutex_unlock(&sc->lock);
+    if (!done) return -1;
+
+    int total = 0;
+    for (int i = 0; i < sc->nchunks; i++) total += sc->chunk_count[i];
+    return total;
+}
+
+int search_count_index(SearchCount *sc, int row, int off) {
+    if (search_count_total(sc) < 0) return -1;
+    if (row < 0 || row >= sc->nrows) return -1;
+
+    int chunk = row / SEARCH_COUNT_CHUNK_ROWS;
+    int n = 0;
+    for (int i = 0; i < chunk; i++) n += sc->chunk_count[i];
+    n += count_rows(sc, sc->re, chunk * SEARCH_COUNT_CHUNK_ROWS, row);
+    return n + count_row(sc, sc->re, &sc->ctx->model.row[row], off);
+}
+
+void search_count_free(SearchCount *sc) {
+    if (!sc) return;
+    uv_mutex_lock(&sc->lock);
+    sc->cancel = 1;
+    uv_mutex_unlock(&sc->lock);
+    if (sc->ntasks > 0) task_token_cancel(&sc->token);
+    for (int i = 0; i < sc->ntasks; i++) task_wait(sc->tasks[i]);
+    uv_mutex_destroy(&sc->lock);
+    regexp_free(sc->re);
+    search_ranges_free(&sc->rows);
+    free(sc->chunk_count);
+    free(sc);
+}
 
 /* Helper function to find the next match in a given direction.
  * Returns the row index of the match, or -1 if not found.
  * Sets match_offset to the column position of the match.
  * This function is exposed for testing purposes. */
 int editor_find_next_match(editor_ctx_t *ctx, const char *query, int start_row, int direction, int *match_offset) {
-    if (!ctx || !query || !match_offset || ctx->model.numrows == 0 || query[0] == '\0') {
+    if (!ctx || !query || !match_offset || editor_numrows(ctx) == 0 || query[0] == '\0') {
         return -1;
     }
 
+    int len = (int)strlen(query);
+    int icase = search_ignores_case(ctx, query, len, 0);
+    if (ctx->model.lazy) {
+        int col, cols;
+        int row = lazy_find(ctx, query, len, icase, start_row, direction, &col, &cols);
+        if (row >= 0) *match_offset = search_render_col(editor_row(ctx, row), col);
+        return row;
+    }
+    SearchPattern pat;
+    search_pattern_init_icase(&pat, query, len, icase);
+    SearchRanges rows = {NULL, 0, 0};
+    search_pattern_rows(ctx, &pat, &rows);
     int current = start_row;
 
-    /* Search through all rows */
-    for (int i = 0; i < ctx->model.numrows; i++) {
-        current += direction;
-
-        /* Wrap around */
-        if (current == -1) {
-            current = ctx->model.numrows - 1;
-        } else if (current == ctx->model.numrows) {
-            current = 0;
-        }
+    /* Search through the rows that can match, wrapping around */
+    int n = search_ranges_rows(&rows);
+    for (int i = 0; i < n; i++) {
+        current = search_ranges_next(&rows, current, direction);
 
         /* Search for query in this row */
-        char *match = strstr(ctx->model.row[current].render, query);
-        if (match) {
-            *match_offset = match - ctx->model.row[current].render;
+        int col = search_row_find(&pat, editor_row(ctx, current));
+        if (col >= 0) {
+            *match_offset = col;
+            search_ranges_free(&rows);
             return current;
         }
     }
 
+    search_ranges_free(&rows);
     return -1;  /* No match found */
 }
 
+/* Mark every match on the screen ('re' NULL: the plain query, ignoring
+ * case if 'icase' is set) */
+static void mark_visible(editor_ctx_t *ctx, const char *query, int qlen,
+                         Regexp *re, int icase) {
+    SearchPattern pat;
+    search_pattern_init_icase(&pat, query, qlen, icase);
+
+    for (int y = 0; y < ctx->view.screenrows; y++) {
+        int line = ctx->view.rowoff + y;
+        t_erow *row = editor_visible_row(ctx, line, ctx->view.coloff,
+                                         ctx->view.screencols);
+        if (!row) break;
+
+        int i = 0, start, end;
+        while (i <= row->size) {
+            if (re) {
+                if (!regexp_search(re, row->chars, row->size, i, &start, &end))
+                    break;
+            } else {
+                const char *m = search_pattern_find(&pat, row->chars + i,
+                                                    (size_t)(row->size - i));
+                if (!m || qlen == 0) break;
+                start = (int)(m - row->chars);
+                end = start + qlen;
+            }
+            editor_decorate(&ctx->model, DECOR_GROUP_SEARCH, line, start,
+                            end - start, HL_MATCH);
+            i = end > start ? end : end + 1;
+        }
+    }
+}
+
 /* Incremental text search with arrow keys navigation.
  * Interactive search that updates as you type and allows navigating
  * between matches. ESC cancels and restores cursor position.
- * ENTER accepts and keeps cursor at current match. */
+ * ENTER accepts and keeps cursor at current match. With :set hlsearch
+ * every match on screen is marked and the prompt shows "n of N", counted
+ * in the background (see search_count_start()). */
 void editor_find(editor_ctx_t *ctx, int fd) {
     char query[KILO_QUERY_LEN+1] = {0};
     int qlen = 0;
     int last_match = -1; /* Last line where a match was found. -1 for none. */
+    int last_off = 0;    /* Its chars offset */
     int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
-    char *saved_hl = NULL;
-
-#define FIND_RESTORE_HL do { \
-    if (saved_hl) { \
-        memcpy(ctx->model.row[saved_hl_line].hl,saved_hl, ctx->model.row[saved_hl_line].rsize); \
-        free(saved_hl); \
-        saved_hl = NULL; \
-    } \
-} while (0)
+    int regex = 0;     /* Query is a regex (Ctrl-R toggles) */
+    SearchCount *count = NULL;       /* hlsearch: matches in the buffer */
+    SearchCache cache;        /* Matches of the query and its prefixes */
+    search_cache_init(&cache);
 
     /* Save the cursor position in order to restore it later. */
     int saved_cx = ctx->view.cx, saved_cy = ctx->view.cy;
     int saved_coloff = ctx->view.coloff, saved_rowoff = ctx->view.rowoff;
+    size_t saved_window = lazy_window(&ctx->model);
+
+    const char *error = NULL; /* Why the regex query does not compile */
+    Regexp *re = NULL;
 
     while(1) {
-        editor_set_status_msg(ctx,
-            "Search: %s (Use ESC/Arrows/Enter)", query);
+        char counted[48] = "";
+        int total = count ? search_count_total(count) : -1;
+        if (count && total < 0) {
+            snprintf(counted, sizeof(counted), " (counting)");
+        } else if (count && last_match >= 0) {
+            snprintf(counted, sizeof(counted), " (%d of %d)",
+                     search_count_index(count, last_match, last_off) + 1, total);
+        } else if (count) {
+            snprintf(counted, sizeof(counted), " (%d matches)", total);
+        }
+
+        if (error)
+            editor_set_status_msg(ctx, "Search (regex): %s (%s)", query, error);
+        else
+            editor_set_status_msg(ctx, "Search%s: %s%s (Use ESC/Arrows/Enter)",
+                                  regex ? " (regex)" : "", query, counted);
         editor_refresh_screen(ctx);
 
+        /* Until a key comes, show the count once it is done */
+        if (count && total < 0) {
+            int ready;
+            while ((ready = terminal_wait_input(fd, 50)) == 0 &&
+                   search_count_total(count) < 0) {}
+            if (ready == 0) continue;
+        }
+
         int c = terminal_read_key(fd);
         if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
             if (qlen != 0) query[--qlen] = '\0';
             last_match = -1;
         } else if (c == ESC || c == ENTER) {
             if (c == ESC) {
+                lazy_return(ctx, saved_window);
                 ctx->view.cx = saved_cx; ctx->view.cy = saved_cy;
                 ctx->view.coloff = saved_coloff; ctx->view.rowoff = saved_rowoff;
             }
-            FIND_RESTORE_HL;
+            editor_undecorate(&ctx->model, DECOR_GROUP_SEARCH);
+            search_count_free(count);
+            search_cache_free(&cache);
             editor_set_status_msg(ctx, "");
             return;
+        } else if (c == CTRL_R) {
+            regex = !regex;
+            last_match = -1;
         } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
             find_next = 1;
         } else if (c == ARROW_LEFT || c == ARROW_UP) {
@@ -114,38 +820,102 @@ void editor_find(editor_ctx_t *ctx, int fd) {
         }
 
         /* Search occurrence. */
-        if (last_match == -1) find_next = 1;
+        re = NULL;
+        error = NULL;
+        int icase = search_ignores_case(ctx, query, qlen, regex);
+        if (regex && qlen)
+            re = search_cache_regexp(&cache, query, qlen,
+                                     icase ? REGEXP_ICASE : 0, &error);
+        if (last_match == -1) {
+            find_next = 1;
+            /* A new query: count it */
+            search_count_free(count);
+            count = NULL;
+            if (ctx->view.hl_search && (re || !regex))
+                count = search_count_start(ctx, query, qlen, regex);
+        }
         if (find_next) {
-            char *match = NULL;
+            int match = 0;
             int match_offset = 0;
+            int match_len = qlen;  /* In render columns */
+            int start = 0, match_end = qlen;   /* In chars */
             int i, current = last_match;
+            /* A file shown a window at a time is searched in full, over
+             * its mapping, by plain queries */
+            int whole = !regex && ctx->model.lazy != NULL;
+            const SearchSet *set = regex || whole ? NULL :
+                search_cache_lookup(&cache, ctx, query, qlen);
 
-            for (i = 0; i < ctx->model.numrows; i++) {
-                current += find_next;
-                if (current == -1) current = ctx->model.numrows-1;
-                else if (current == ctx->model.numrows) current = 0;
-                match = strstr(ctx->model.row[current].render,query);
-                if (match) {
-                    match_offset = match-ctx->model.row[current].render;
-                    break;
+            SearchPattern pat;
+            search_pattern_init_icase(&pat, query, qlen, icase);
+            SearchRanges rows = {NULL, 0, 0};
+            if (regex && re) search_regexp_rows(ctx, re, &rows);
+            else if (!regex && !set && !whole) search_pattern_rows(ctx, &pat, &rows);
+
+            if (whole) {
+                int cols = 0;
+                int found = qlen > 0 ? lazy_find(ctx, query, qlen, icase, current,
+                                                 find_next, &start, &cols) : -1;
+                if (found >= 0) {
+                    t_erow *row = editor_row(ctx, found);
+                    match = 1;
+                    current = found;
+                    match_end = start + cols;
+                    match_offset = search_render_col(row, start);
+                    match_len = search_render_col(row, match_end) - match_offset;
+                }
+            } else if (regex) {
+                int n = search_ranges_rows(&rows);
+                for (i = 0; i < n; i++) {
+                    current = search_ranges_next(&rows, current, find_next);
+                    t_erow *row = editor_row(ctx, current);
+                    if (regexp_search(re, row->chars, row->size, 0,
+                                      &start, &match_end)) {
+                        match = 1;
+                        match_offset = search_render_col(row, start);
+                        match_len = search_render_col(row, match_end) - match_offset;
+                        break;
+                    }
+                }
+            } else if (set) {
+                i = search_set_next(set, current, find_next);
+                if (i >= 0) {
+                    match = 1;
+                    current = set->m[i].row;
+                    start = set->m[i].off;
+                    match_end = start + qlen;
+                    match_offset = search_render_col(editor_row(ctx, current),
+                                                     start);
+                }
+            } else {
+                int n = search_ranges_rows(&rows);
+                for (i = 0; i < n; i++) {
+                    current = search_ranges_next(&rows, current, find_next);
+                    t_erow *row = editor_row(ctx, current);
+                    const char *m = search_pattern_find(&pat, row->chars,
+                                                        (size_t)row->size);
+                    if (m) {
+                        match = 1;
+                        start = (int)(m - row->chars);
+                        match_end = start + qlen;
+                        match_offset = search_render_col(row, start);
+                        break;
+                    }
                 }
             }
+            search_ranges_free(&rows);
             find_next = 0;
 
             /* Highlight */
-            FIND_RESTORE_HL;
+            editor_undecorate(&ctx->model, DECOR_GROUP_SEARCH);
 
             if (match) {
-                t_erow *row = &ctx->model.row[current];
+                editor_visible_row(ctx, current, match_offset, match_len);
                 last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = malloc(row->rsize);
-                    if (saved_hl) {
-                        memcpy(saved_hl,row->hl,row->rsize);
-                    }
-                    memset(row->hl+match_offset,HL_MATCH,qlen);
-                }
+                last_off = start;
+                if (!ctx->view.hl_search)
+                    editor_decorate(&ctx->model, DECOR_GROUP_SEARCH, current,
+                                    start, match_end - start, HL_MATCH);
                 ctx->view.cy = 0;
                 ctx->view.cx = match_offset;
                 ctx->view.rowoff = current;
@@ -157,6 +927,8 @@ void editor_find(editor_ctx_t *ctx, int fd) {
                     ctx->view.coloff += diff;
                 }
             }
+            if (ctx->view.hl_search && qlen && (re || !regex))
+                mark_visible(ctx, query, qlen, re, icase);
         }
     }
 }
@@ -9,6 +9,139 @@
 #define LOKI_SEARCH_H
 
 #include "internal.h"
+#include "regexp.h"
+#include "search_index.h"
+#include <stddef.h>
+
+/* Needles at least this long skip with a Horspool table; shorter ones are
+ * found by first/last byte filtering (see search.c). */
+#define SEARCH_SKIP_MIN 8
+
+/* A query compiled once and then run over many rows. */
+typedef struct SearchPattern {
+    const char *needle;       /* Not owned; must outlive the pattern */
+    int len;
+    int skip[256];            /* Horspool shifts, for len >= SEARCH_SKIP_MIN */
+    int icase;                /* Letters match in either case */
+    int ascii;                /* The needle is all ASCII */
+    int nanchor;              /* icase: 0-2 bytes checked before comparing */
+    int anchor[2];            /* ... at these offsets, as byte | mask == val */
+    unsigned char anchor_mask[2], anchor_val[2];
+} SearchPattern;
+
+/* Compile the 'len' bytes at 'needle'. */
+void search_pattern_init(SearchPattern *pat, const char *needle, int len);
+
+/* Compile the 'len' bytes at 'needle', to ignore case if 'icase' is set:
+ * ASCII letters, and the two-byte UTF-8 letters of Latin-1, Latin
+ * Extended-A, Greek and Cyrillic, match in either case. A letter and its
+ * other case have the same length, so a match is always 'len' bytes. */
+void search_pattern_init_icase(SearchPattern *pat, const char *needle,
+                               int len, int icase);
+
+/* Whether the pattern matches the 'len' bytes at 's'. */
+int search_pattern_equal(const SearchPattern *pat, const char *s);
+
+/* Whether a search for the 'len' bytes at 'query' (a regex if 'regex' is
+ * set) ignores case: with :set ignorecase, unless :set smartcase is on
+ * too and the query has an upper case letter (escapes in a regex aside). */
+int search_ignores_case(const editor_ctx_t *ctx, const char *query, int len,
+                        int regex);
+
+/* First occurrence of the pattern in the 'len' bytes at 'hay', or NULL. An
+ * empty pattern matches at 'hay'. */
+const char *search_pattern_find(const SearchPattern *pat, const char *hay,
+                                size_t len);
+
+/* Render column of the first match in the row, or -1. The row's chars are
+ * searched, so long rows are searched past their render window. */
+int search_row_find(const SearchPattern *pat, t_erow *row);
+
+/* The rows of 'ctx' that can hold a match of 'pat', or of regex 're', go to
+ * 'rows': those the search index lists, or every row when it has no
+ * answer (see search_index_lookup()). */
+void search_pattern_rows(editor_ctx_t *ctx, const SearchPattern *pat,
+                         SearchRanges *rows);
+void search_regexp_rows(editor_ctx_t *ctx, const Regexp *re,
+                        SearchRanges *rows);
+
+/* Match sets for incremental search. A query that extends the previous one
+ * can only match where that one did, so its matches are found by checking
+ * the previous set instead of the buffer; deleting characters brings the
+ * shorter query's set back. Sets of more than SEARCH_SET_MAX matches are
+ * not kept (searching then scans rows). Edits to the buffer drop them. */
+#define SEARCH_SET_MAX (1 << 20)
+
+typedef struct SearchMatch {
+    int row;
+    int off;                  /* Offset in row->chars */
+} SearchMatch;
+
+typedef struct SearchSet {
+    SearchMatch *m;           /* Every match, ordered by row and offset */
+    int n, cap;
+    int state;                /* 1: m is valid, -1: too many, 0: not built */
+    int icase;                /* Built ignoring case */
+} SearchSet;
+
+typedef struct SearchCache {
+    char query[KILO_QUERY_LEN+1];     /* Query the sets are prefixes of */
+    int qlen;
+    unsigned long damage_gen;         /* model.damage_gen they are for */
+    SearchSet set[KILO_QUERY_LEN+1];  /* set[k]: matches of query[0..k) */
+    Regexp *re;                       /* Regex mode: re_query compiled */
+    char re_query[KILO_QUERY_LEN+1];
+    int re_len, re_flags;
+} SearchCache;
+
+void search_cache_init(SearchCache *cache);
+void search_cache_free(SearchCache *cache);
+
+/* Matches of the 'len' bytes at 'query', or NULL when there are too many
+ * to keep or 'len' is 0. Case is ignored as search_ignores_case() says.
+ * Valid until the next call. */
+const SearchSet *search_cache_lookup(SearchCache *cache, editor_ctx_t *ctx,
+                                     const char *query, int len);
+
+/* 'query' compiled as a regex with REGEXP_* 'flags', or NULL with *error
+ * set. Compiled again only when the query or flags change. Owned by the
+ * cache. */
+Regexp *search_cache_regexp(SearchCache *cache, const char *query, int len,
+                            int flags, const char **error);
+
+/* Index in 'set' of the first match in the nearest row after 'from_row'
+ * ('direction' 1) or before it (-1), wrapping around; -1 if set is empty. */
+int search_set_next(const SearchSet *set, int from_row, int direction);
+
+/* Render column of a match at chars offset 'off' in 'row'. */
+int search_render_col(t_erow *row, int off);
+
+/* Background match counting, for "n of N" with :set hlsearch. Chunks of
+ * SEARCH_COUNT_CHUNK_ROWS rows are handed to a pool of threads; buffers of
+ * fewer than SEARCH_COUNT_PARALLEL_ROWS rows are counted at once on the
+ * calling thread. Matches do not overlap. The rows must not change until
+ * the count is freed. */
+#define SEARCH_COUNT_CHUNK_ROWS 4096
+#define SEARCH_COUNT_PARALLEL_ROWS 16384
+#define SEARCH_COUNT_MAX_WORKERS 64
+
+typedef struct SearchCount SearchCount;
+
+/* Start counting the matches of the 'len' bytes at 'query' (a regex if
+ * 'regex' is set), ignoring case as search_ignores_case() says. Returns
+ * NULL if 'len' is 0 or the regex is invalid. */
+SearchCount *search_count_start(editor_ctx_t *ctx, const char *query,
+                                int len, int regex);
+
+/* Matches in the buffer, or -1 while still counting. */
+int search_count_total(SearchCount *sc);
+
+/* Matches that start before chars offset 'off' of 'row', or -1 while
+ * still counting. */
+int search_count_index(SearchCount *sc, int row, int off);
+
+/* Stop counting and free 'sc'. */
+void search_count_free(SearchCount *sc);
 
 /* Incremental text search with arrow key navigation
  * Allows user to search forward/backward, cancel with ESC,
@@ -0,0 +1,544 @@
+/* search_index.c - Trigram index of a buffer's rows
+ *
+ * See search_index.h. The lists are kept in one array: bucket k's blocks
+ * are post[start[k] .. start[k+1]), ascending. The build makes two passes
+ * over the rows, one counting each bucket's blocks and one filling them
+ * in; a stamp per bucket (the last block it was seen in) keeps a block
+ * from being listed twice.
+ *
+ * Rows an edit moves are followed with runs: the current rows are, in
+ * order, stretches of rows that were built from (orig >= 0, the row they
+ * were then) and stretches of rows inserted or changed since (orig -1),
+ * which every lookup includes.
+ */
+
+#include "search_index.h"
+#include "task_pool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+enum { INDEX_EMPTY, INDEX_BUILDING, INDEX_READY };
+
+typedef struct IndexRun {
+    int orig;                 /* Row the run started at when built, or -1 */
+    int len;
+} IndexRun;
+
+struct SearchIndex {
+    int state;
+    int shift;                /* Rows per block: 1 << shift */
+    int nblocks;
+    uint32_t *start;          /* SEARCH_INDEX_BUCKETS + 1 offsets in post */
+    uint16_t *post;           /* Blocks of each bucket */
+    uint8_t *common;          /* Bit per bucket: too common to be listed */
+
+    /* The build, reading a snapshot of the rows */
+    Task *task;
+    const t_erow *rows;
+    int nrows;
+    TaskToken token;          /* Cancelled to stop it */
+    atomic_int done;
+    int ok;
+
+    /* The current rows in terms of the ones built from */
+    IndexRun *runs;
+    int nruns, runcap;
+    int total;                /* Rows in the runs */
+    int changed;              /* Rows in runs with orig -1 */
+};
+
+/* ======================= Ranges ============================================ */
+
+void search_ranges_free(SearchRanges *rs) {
+    free(rs->r);
+    rs->r = NULL;
+    rs->n = rs->cap = 0;
+}
+
+void search_ranges_add(SearchRanges *rs, int first, int last) {
+    if (rs->n > 0 && first <= rs->r[rs->n - 1].last + 1) {
+        if (last > rs->r[rs->n - 1].last) rs->r[rs->n - 1].last = last;
+        return;
+    }
+    if (rs->n == rs->cap) {
+        int cap = rs->cap ? rs->cap * 2 : 16;
+        SearchRange *r = realloc(rs->r, sizeof(SearchRange) * (size_t)cap);
+        if (r == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        rs->r = r;
+        rs->cap = cap;
+    }
+    rs->r[rs->n].first = first;
+    rs->r[rs->n].last = last;
+    rs->n++;
+}
+
+int search_ranges_find(const SearchRanges *rs, int row) {
+    int lo = 0, hi = rs->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (rs->r[mid].last < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int search_ranges_next(const SearchRanges *rs, int row, int direction) {
+    if (rs->n == 0) return -1;
+    if (direction > 0) {
+        int i = search_ranges_find(rs, row + 1);
+        if (i == rs->n) return rs->r[0].first;
+        return row + 1 > rs->r[i].first ? row + 1 : rs->r[i].first;
+    }
+    int i = search_ranges_find(rs, row - 1);
+    if (i < rs->n && rs->r[i].first <= row - 1) return row - 1;
+    return i > 0 ? rs->r[i - 1].last : rs->r[rs->n - 1].last;
+}
+
+int search_ranges_rows(const SearchRanges *rs) {
+    int n = 0;
+    for (int i = 0; i < rs->n; i++) n += rs->r[i].last - rs->r[i].first + 1;
+    return n;
+}
+
+/* ======================= Building ========================================== */
+
+static inline uint32_t fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + 32u : c;
+}
+
+static inline uint32_t bucket(uint32_t trigram) {
+    return (trigram * 2654435761u) >> (32 - 20);
+}
+
+/* Note block 'b' in the lists of the trigrams of its rows: count it in
+ * count[k] or, once 'post' is allocated, add it at post[fill[k]]. */
+static void scan_block(const SearchIndex *ix, int b, uint16_t *stamp,
+                       uint32_t *count, uint16_t *post, uint32_t *fill,
+                       const uint8_t *common) {
+    int first = b << ix->shift;
+    int last = first + (1 << ix->shift);
+    if (last > ix->nrows) last = ix->nrows;
+
+    for (int r = first; r < last; r++) {
+        const unsigned char *s = (const unsigned char *)ix->rows[r].chars;
+        int n = ix->rows[r].size;
+        if (n < 3) continue;
+        uint32_t t = fold(s[0]) << 8 | fold(s[1]);
+        for (int j = 2; j < n; j++) {
+            t = (t << 8 | fold(s[j])) & 0xffffff;
+            uint32_t k = bucket(t);
+            if (stamp[k] == b) continue;
+            stamp[k] = (uint16_t)b;
+            if (post == NULL) count[k]++;
+            else if (!(common[k / 8] & (1u << (k % 8))))
+                post[fill[k]++] = (uint16_t)b;
+        }
+    }
+}
+
+static void index_free_lists(SearchIndex *ix) {
+    free(ix->start);
+    free(ix->post);
+    free(ix->common);
+    ix->start = NULL;
+    ix->post = NULL;
+    ix->common = NULL;
+    ix->nruns = ix->total = ix->changed = 0;
+}
+
+static void build_worker(void *arg) {
+    SearchIndex *ix = arg;
+    uint32_t *start = calloc(SEARCH_INDEX_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t *fill = malloc(sizeof(uint32_t) * SEARCH_INDEX_BUCKETS);
+    uint16_t *stamp = malloc(sizeof(uint16_t) * SEARCH_INDEX_BUCKETS);
+    uint8_t *common = calloc(SEARCH_INDEX_BUCKETS / 8, 1);
+    uint16_t *post = NULL;
+    if (!start || !fill || !stamp || !common) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    /* Count the blocks of each bucket */
+    memset(stamp, 0xff, sizeof(uint16_t) * SEARCH_INDEX_BUCKETS);
+    for (int b = 0; b < ix->nblocks; b++) {
+        if (task_cancelled()) goto out;
+        scan_block(ix, b, stamp, start, NULL, NULL, NULL);
+    }
+
+    /* Drop the common ones, then turn counts into offsets */
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < SEARCH_INDEX_BUCKETS; k++) {
+        uint32_t n = start[k];
+        if (n * 2 > (uint32_t)ix->nblocks) {
+            common[k / 8] |= (uint8_t)(1u << (k % 8));
+            n = 0;
+        }
+        start[k] = fill[k] = total;
+        total += n;
+    }
+    start[SEARCH_INDEX_BUCKETS] = total;
+
+    post = malloc(sizeof(uint16_t) * (total ? total : 1));
+    if (post == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memset(stamp, 0xff, sizeof(uint16_t) * SEARCH_INDEX_BUCKETS);
+    for (int b = 0; b < ix->nblocks; b++) {
+        if (task_cancelled()) goto out;
+        scan_block(ix, b, stamp, NULL, post, fill, common);
+    }
+
+    ix->start = start;
+    ix->post = post;
+    ix->common = common;
+    start = NULL;
+    post = NULL;
+    common = NULL;
+    ix->ok = 1;
+out:
+    free(start);
+    free(fill);
+    free(stamp);
+    free(common);
+    free(post);
+    atomic_store(&ix->done, 1);
+}
+
+static void build_start(SearchIndex *ix, EditorModel *model) {
+    index_free_lists(ix);
+    ix->rows = model->row;
+    ix->nrows = model->numrows;
+    ix->shift = 0;
+    while ((1 << ix->shift) < SEARCH_INDEX_BLOCK_MIN ||
+           ((ix->nrows - 1) >> ix->shift) + 1 > SEARCH_INDEX_MAX_BLOCKS)
+        ix->shift++;
+    ix->nblocks = ix->nrows ? ((ix->nrows - 1) >> ix->shift) + 1 : 0;
+    ix->ok = 0;
+    task_token_init(&ix->token);
+    atomic_store(&ix->done, 0);
+    ix->state = INDEX_BUILDING;
+    ix->task = task_submit(build_worker, ix, TASK_PRIORITY_LOW, &ix->token);
+    if (ix->task == NULL)
+        ix->state = INDEX_EMPTY;  /* No thread: searches scan the rows */
+}
+
+/* Join the build; it is kept if it got to the end */
+static void build_finish(SearchIndex *ix) {
+    task_wait(ix->task);
+    ix->task = NULL;
+    if (!ix->ok) {
+        ix->state = INDEX_EMPTY;
+        return;
+    }
+    ix->state = INDEX_READY;
+    ix->nruns = 0;
+    ix->total = ix->changed = 0;
+    if (ix->nrows > 0) {
+        if (ix->runcap == 0) {
+            ix->runs = malloc(sizeof(IndexRun) * 16);
+            if (ix->runs == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+            ix->runcap = 16;
+        }
+        ix->runs[0].orig = 0;
+        ix->runs[0].len = ix->nrows;
+        ix->nruns = 1;
+        ix->total = ix->nrows;
+    }
+}
+
+void search_index_enable(EditorModel *model) {
+    search_index_disable(model);
+    SearchIndex *ix = calloc(1, sizeof(SearchIndex));
+    if (ix == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    model->search_index = ix;
+    build_start(ix, model);
+}
+
+void search_index_disable(EditorModel *model) {
+    SearchIndex *ix = model->search_index;
+    if (ix == NULL) return;
+    search_index_stop(model);
+    index_free_lists(ix);
+    free(ix->runs);
+    free(ix);
+    model->search_index = NULL;
+}
+
+void search_index_wait(EditorModel *model) {
+    SearchIndex *ix = model->search_index;
+    if (ix && ix->state == INDEX_BUILDING) build_finish(ix);
+}
+
+void search_index_stop(EditorModel *model) {
+    SearchIndex *ix = model->search_index;
+    if (ix == NULL || ix->state != INDEX_BUILDING) return;
+    task_token_cancel(&ix->token);
+    build_finish(ix);
+}
+
+/* ======================= Edits ============================================= */
+
+static void runs_insert(SearchIndex *ix, int i, int orig, int len) {
+    if (ix->nruns == ix->runcap) {
+        int cap = ix->runcap ? ix->runcap * 2 : 16;
+        IndexRun *runs = realloc(ix->runs, sizeof(IndexRun) * (size_t)cap);
+        if (runs == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        ix->runs = runs;
+        ix->runcap = cap;
+    }
+    memmove(ix->runs + i + 1, ix->runs + i,
+            sizeof(IndexRun) * (size_t)(ix->nruns - i));
+    ix->runs[i].orig = orig;
+    ix->runs[i].len = len;
+    ix->nruns++;
+}
+
+/* Index of the run starting at current row 'row', splitting the one
+ * around it; ix->nruns if 'row' is the end */
+static int runs_split(SearchIndex *ix, int row) {
+    int cur = 0;
+    for (int i = 0; i < ix->nruns; i++) {
+        IndexRun *run = &ix->runs[i];
+        if (cur == row) return i;
+        if (row < cur + run->len) {
+            int head = row - cur;
+            int orig = run->orig < 0 ? -1 : run->orig + head;
+            int tail = run->len - head;
+            run->len = head;
+            runs_insert(ix, i + 1, orig, tail);
+            return i + 1;
+        }
+        cur += run->len;
+    }
+    return ix->nruns;
+}
+
+/* Drop emptied runs next to run i and join the ones that continue each
+ * other; the runs further away are already joined */
+static void runs_merge(SearchIndex *ix, int i) {
+    int lo = i > 0 ? i - 1 : 0;
+    int hi = i + 2 < ix->nruns ? i + 2 : ix->nruns;
+    int w = lo;
+    for (int j = lo; j < hi; j++) {
+        IndexRun run = ix->runs[j];
+        if (run.len == 0) continue;
+        if (w > lo) {
+            IndexRun *prev = &ix->runs[w - 1];
+            if (prev->orig < 0 ? run.orig < 0
+                               : prev->orig + prev->len == run.orig) {
+                prev->len += run.len;
+                continue;
+            }
+        }
+        ix->runs[w++] = run;
+    }
+    memmove(ix->runs + w, ix->runs + hi,
+            sizeof(IndexRun) * (size_t)(ix->nruns - hi));
+    ix->nruns -= hi - w;
+}
+
+/* The index once edits are noted, or NULL when there is none to keep up */
+static SearchIndex *index_for_edit(EditorModel *model) {
+    SearchIndex *ix = model->search_index;
+    if (ix == NULL) return NULL;
+    search_index_stop(model);
+    return ix->state == INDEX_READY ? ix : NULL;
+}
+
+/* Too much to search in full: build again at the next lookup */
+static void index_check_edits(SearchIndex *ix) {
+    if (ix->nruns > SEARCH_INDEX_MAX_RUNS || ix->changed > ix->nrows / 4 + 64) {
+        index_free_lists(ix);
+        ix->state = INDEX_EMPTY;
+    }
+}
+
+void search_index_note_insert(EditorModel *model, int at) {
+    SearchIndex *ix = index_for_edit(model);
+    if (ix == NULL || at < 0 || at > ix->total) return;
+    int i = runs_split(ix, at);
+    runs_insert(ix, i, -1, 1);
+    ix->total++;
+    ix->changed++;
+    runs_merge(ix, i);
+    index_check_edits(ix);
+}
+
+void search_index_note_delete(EditorModel *model, int at) {
+    SearchIndex *ix = index_for_edit(model);
+    if (ix == NULL || at < 0 || at >= ix->total) return;
+    int i = runs_split(ix, at);
+    runs_split(ix, at + 1);
+    if (ix->runs[i].orig < 0) ix->changed--;
+    ix->runs[i].len = 0;
+    ix->total--;
+    runs_merge(ix, i);
+    index_check_edits(ix);
+}
+
+void search_index_note_change(EditorModel *model, int at) {
+    SearchIndex *ix = index_for_edit(model);
+    if (ix == NULL || at < 0 || at >= ix->total) return;
+    int i = runs_split(ix, at);
+    runs_split(ix, at + 1);
+    if (ix->runs[i].orig >= 0) {
+        ix->runs[i].orig = -1;
+        ix->changed++;
+    }
+    runs_merge(ix, i);
+    index_check_edits(ix);
+}
+
+/* ======================= Lookup ============================================ */
+
+typedef struct PostList {
+    const uint16_t *p;
+    uint32_t n;
+} PostList;
+
+static int compare_lists(const void *a, const void *b) {
+    uint32_t na = ((const PostList *)a)->n, nb = ((const PostList *)b)->n;
+    return na < nb ? -1 : na > nb;
+}
+
+/* First index in list[from..n) holding a block >= 'b', found by galloping */
+static uint32_t list_seek(const PostList *list, uint32_t from, uint16_t b) {
+    uint32_t step = 1, hi = from;
+    while (hi < list->n && list->p[hi] < b) {
+        from = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > list->n) hi = list->n;
+    while (from < hi) {
+        uint32_t mid = from + (hi - from) / 2;
+        if (list->p[mid] < b) from = mid + 1;
+        else hi = mid;
+    }
+    return from;
+}
+
+/* The rows of run 'run' (starting at current row 'cur') in the blocks
+ * cand[0..ncand) */
+static void add_run_rows(const SearchIndex *ix, const IndexRun *run, int cur,
+                         const uint16_t *cand, int ncand, SearchRanges *out) {
+    if (run->orig < 0) {
+        search_ranges_add(out, cur, cur + run->len - 1);
+        return;
+    }
+    int o0 = run->orig, o1 = run->orig + run->len - 1;
+    int lo = 0, hi = ncand, b0 = o0 >> ix->shift;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cand[mid] < b0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int i = lo; i < ncand && (cand[i] << ix->shift) <= o1; i++) {
+        int first = cand[i] << ix->shift;
+        int last = first + (1 << ix->shift) - 1;
+        if (first < o0) first = o0;
+        if (last > o1) last = o1;
+        search_ranges_add(out, cur + first - o0, cur + last - o0);
+    }
+}
+
+/* Whether the index can answer a lookup now */
+static int index_ready(EditorModel *model) {
+    SearchIndex *ix = model->search_index;
+    if (ix == NULL) return 0;
+    if (ix->state == INDEX_BUILDING) {
+        if (!atomic_load(&ix->done)) return 0;
+        build_finish(ix);
+    }
+    /* Rows that changed without a note: start over */
+    if (ix->state == INDEX_READY && ix->total != model->numrows) {
+        index_free_lists(ix);
+        ix->state = INDEX_EMPTY;
+    }
+    if (ix->state != INDEX_READY) {
+        build_start(ix, model);
+        return 0;
+    }
+    return 1;
+}
+
+int search_index_lookup(EditorModel *model, const char *lit, int len,
+                        SearchRanges *out) {
+    SearchIndex *ix = model->search_index;
+    out->n = 0;
+    if (len < 3 || !index_ready(model)) {
+        if (model->numrows > 0) search_ranges_add(out, 0, model->numrows - 1);
+        return -1;
+    }
+
+    /* The block lists of the literal's trigrams, shortest first */
+    PostList *lists = malloc(sizeof(PostList) * (size_t)(len - 2));
+    if (lists == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    const unsigned char *s = (const unsigned char *)lit;
+    int nlists = 0;
+    uint32_t t = fold(s[0]) << 8 | fold(s[1]);
+    for (int j = 2; j < len; j++) {
+        t = (t << 8 | fold(s[j])) & 0xffffff;
+        uint32_t k = bucket(t);
+        if (ix->common[k / 8] & (1u << (k % 8))) continue;
+        lists[nlists].p = ix->post + ix->start[k];
+        lists[nlists].n = ix->start[k + 1] - ix->start[k];
+        nlists++;
+    }
+
+    if (nlists == 0) {
+        /* Only common trigrams: any row may match */
+        free(lists);
+        if (model->numrows > 0) search_ranges_add(out, 0, model->numrows - 1);
+        return 0;
+    }
+    qsort(lists, (size_t)nlists, sizeof(PostList), compare_lists);
+
+    /* Blocks in every list */
+    uint16_t *cand = malloc(sizeof(uint16_t) * (lists[0].n ? lists[0].n : 1));
+    if (cand == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(cand, lists[0].p, sizeof(uint16_t) * lists[0].n);
+    int ncand = (int)lists[0].n;
+    for (int l = 1; l < nlists && ncand > 0; l++) {
+        uint32_t at = 0;
+        int kept = 0;
+        for (int i = 0; i < ncand; i++) {
+            at = list_seek(&lists[l], at, cand[i]);
+            if (at == lists[l].n) break;
+            if (lists[l].p[at] == cand[i]) cand[kept++] = cand[i];
+        }
+        ncand = kept;
+    }
+    free(lists);
+
+    int cur = 0;
+    for (int i = 0; i < ix->nruns; i++) {
+        add_run_rows(ix, &ix->runs[i], cur, cand, ncand, out);
+        cur += ix->runs[i].len;
+    }
+    free(cand);
+    return 0;
+}
@@ -0,0 +1,94 @@
+/* search_index.h - Trigram index of a buffer's rows
+ *
+ * Searching a long buffer for a rare string mostly reads rows that cannot
+ * match. The index lists, for every three-byte sequence (ASCII case
+ * folded), the blocks of rows it occurs in; a string of three or more
+ * bytes can only be in the blocks listed for all of its trigrams, so a
+ * search reads just those. Literal queries give their own trigrams,
+ * regex queries the bytes every match has to contain (see
+ * regexp_required()).
+ *
+ * The index is built on a background thread, over the rows as they are
+ * when the build starts. An edit stops a build in progress before the
+ * rows change (as it waits for an async save), and is afterwards recorded as
+ * a run of rows to search in full; once too much of the buffer is such
+ * runs the index is dropped and built again at the next lookup.
+ * editor_open() indexes buffers of SEARCH_INDEX_MIN_ROWS rows or more;
+ * :set searchindex turns the index on or off for the current buffer.
+ */
+
+#ifndef LOKI_SEARCH_INDEX_H
+#define LOKI_SEARCH_INDEX_H
+
+#include "internal.h"
+
+/* editor_open() indexes buffers with at least this many rows */
+#define SEARCH_INDEX_MIN_ROWS 100000
+
+/* Rows are indexed in blocks of a power of two rows, at least
+ * SEARCH_INDEX_BLOCK_MIN and few enough for SEARCH_INDEX_MAX_BLOCKS */
+#define SEARCH_INDEX_BLOCK_MIN 64
+#define SEARCH_INDEX_MAX_BLOCKS 8192
+
+/* Trigrams are hashed into this many lists; a trigram in more than half
+ * of the blocks is not listed, as it would not narrow a search */
+#define SEARCH_INDEX_BUCKETS (1 << 20)
+
+/* Edited stretches of rows tracked before the index is rebuilt */
+#define SEARCH_INDEX_MAX_RUNS 4096
+
+typedef struct SearchIndex SearchIndex;
+
+/* Rows first..last (inclusive) */
+typedef struct SearchRange {
+    int first, last;
+} SearchRange;
+
+/* Ascending, non-overlapping ranges of rows */
+typedef struct SearchRanges {
+    SearchRange *r;
+    int n, cap;
+} SearchRanges;
+
+void search_ranges_free(SearchRanges *rs);
+
+/* Add rows first..last, after (or joining) the last range. */
+void search_ranges_add(SearchRanges *rs, int first, int last);
+
+/* Index of the first range ending at 'row' or after it (rs->n if none). */
+int search_ranges_find(const SearchRanges *rs, int row);
+
+/* The nearest row in the ranges after 'row' ('direction' 1) or before it
+ * (-1), wrapping around; -1 if the ranges are empty. */
+int search_ranges_next(const SearchRanges *rs, int row, int direction);
+
+/* Rows in the ranges. */
+int search_ranges_rows(const SearchRanges *rs);
+
+/* Index 'model' (again, if it already is). Returns at once; the index is
+ * used once the background build is done. */
+void search_index_enable(EditorModel *model);
+
+/* Drop the index, stopping its build. */
+void search_index_disable(EditorModel *model);
+
+/* Wait for a build in progress. For tests. */
+void search_index_wait(EditorModel *model);
+
+/* Stop a build in progress before the rows change. A finished build is
+ * kept. Cheap when nothing is building. */
+void search_index_stop(EditorModel *model);
+
+/* Tell the index that row 'at' was inserted, deleted or changed. */
+void search_index_note_insert(EditorModel *model, int at);
+void search_index_note_delete(EditorModel *model, int at);
+void search_index_note_change(EditorModel *model, int at);
+
+/* The rows of 'model' that may contain the 'len' bytes at 'lit' (ASCII
+ * case aside) go to 'out'. Returns 0, or -1 with every row in 'out' when
+ * the index has no answer: there is none, it is still building (a build
+ * is started if it was dropped after edits), or 'len' is below 3. */
+int search_index_lookup(EditorModel *model, const char *lit, int len,
+                        SearchRanges *out);
+
+#endif /* LOKI_SEARCH_INDEX_H */
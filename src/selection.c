@@ -5,9 +5,11 @@
  * that works over SSH and doesn't require X11 or platform-specific APIs.
  *
  * Features:
- * - Visual selection checking (is position within selection?)
+ * - Visual selection checking (is position within selection?), of text
+ *   or of a block (a rectangle of columns)
  * - Base64 encoding for OSC 52 clipboard protocol
- * - Copy selection to clipboard using terminal escape sequences
+ * - Copy selection to clipboard using terminal escape sequences, streamed
+ *   from the rows in chunks (cancellable with Ctrl-C)
  *
  * OSC 52 Protocol:
  * - Sequence: ESC]52;c;<base64_text>BEL
@@ -16,21 +18,43 @@
  */
 
 #include "selection.h"
+#include "multicursor.h"
 #include "internal.h"
+#include "save.h"
+#include "terminal.h"
+#include "undo.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
 
 /* Base64 encoding table for OSC 52 clipboard protocol */
 static const char base64_table[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-/* Check if a position (row, col) is within the current selection.
- * Returns 1 if selected, 0 otherwise.
- * Handles both single-line and multi-line selections. */
-int is_selected(editor_ctx_t *ctx, int row, int col) {
-    if (!ctx->view.sel_active) return 0;
+/* Largest selection copied, 0 for no limit (:set clipmax) */
+static size_t clipboard_max = CLIPBOARD_MAX_DEFAULT;
+
+void selection_set_clipboard_max(size_t bytes) {
+    clipboard_max = bytes;
+}
+
+size_t selection_get_clipboard_max(void) {
+    return clipboard_max;
+}
+
+/* Columns [*start, *end) of 'row' covered by the current selection.
+ * Returns 0 if the row has no selected columns. */
+int selection_row_span(editor_ctx_t *ctx, int row, int *start, int *end) {
+    if (!ctx->view.sel_active) {
+        /* Extra cursors (multicursor.h) show as one selected column */
+        if (ctx->view.cursor_count == 0 || !multicursor_on_row(ctx, row, start))
+            return 0;
+        *end = *start + 1;
+        return 1;
+    }
 
     int start_y = ctx->view.sel_start_y;
     int start_x = ctx->view.sel_start_x;
@@ -47,71 +71,239 @@ int is_selected(editor_ctx_t *ctx, int row, int col) {
     /* Check if row is in range */
     if (row < start_y || row > end_y) return 0;
 
-    /* Single line selection */
-    if (start_y == end_y) {
-        return col >= start_x && col < end_x;
+    if (ctx->view.sel_block) {
+        *start = start_x < end_x ? start_x : end_x;
+        *end = (start_x < end_x ? end_x : start_x) + 1;
+        return 1;
     }
 
-    /* Multi-line selection */
-    if (row == start_y) {
-        return col >= start_x;
-    } else if (row == end_y) {
-        return col < end_x;
-    } else {
-        return 1; /* Entire line selected */
+    *start = (row == start_y) ? start_x : 0;
+    *end = (row == end_y) ? end_x : INT_MAX;  /* Open: rest of the line */
+    return *start < *end;
+}
+
+/* Check if a position (row, col) is within the current selection.
+ * Returns 1 if selected, 0 otherwise.
+ * Handles both single-line and multi-line selections. */
+int is_selected(editor_ctx_t *ctx, int row, int col) {
+    int start, end;
+    if (!ctx->view.sel_active || !selection_row_span(ctx, row, &start, &end)) return 0;
+    return col >= start && col < end;
+}
+
+/* Every 12 bits of input as their two output characters, so a group of
+ * three bytes takes two loads instead of four. Filled on first use. */
+static char base64_pairs[4096][2];
+
+static void fill_pairs(void) {
+    if (base64_pairs[0][0]) return;
+    for (int i = 0; i < 4096; i++) {
+        base64_pairs[i][0] = base64_table[i >> 6];
+        base64_pairs[i][1] = base64_table[i & 0x3F];
+    }
+}
+
+static inline void encode_group(const unsigned char *in, char *out) {
+    uint32_t triple = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+    memcpy(out, base64_pairs[triple >> 12], 2);
+    memcpy(out + 2, base64_pairs[triple & 0xFFF], 2);
+}
+
+/* The whole groups of three in 'len' bytes, four at a time where it can.
+ * Returns the bytes written. */
+static size_t encode_groups(const unsigned char *in, size_t len, char *out) {
+    fill_pairs();
+    size_t i = 0, j = 0;
+    for (; i + 12 <= len; i += 12, j += 16) {
+        encode_group(in + i, out + j);
+        encode_group(in + i + 3, out + j + 4);
+        encode_group(in + i + 6, out + j + 8);
+        encode_group(in + i + 9, out + j + 12);
     }
+    for (; i + 3 <= len; i += 3, j += 4) encode_group(in + i, out + j);
+    return j;
+}
+
+/* The last one or two bytes, padded */
+static size_t encode_tail(const unsigned char *in, size_t len, char *out) {
+    if (len == 0) return 0;
+    uint32_t triple = ((uint32_t)in[0] << 16) | (len > 1 ? (uint32_t)in[1] << 8 : 0);
+    out[0] = base64_table[(triple >> 18) & 0x3F];
+    out[1] = base64_table[(triple >> 12) & 0x3F];
+    out[2] = len > 1 ? base64_table[(triple >> 6) & 0x3F] : '=';
+    out[3] = '=';
+    return 4;
+}
+
+size_t base64_encode_to(const char *input, size_t len, char *output) {
+    const unsigned char *in = (const unsigned char *)input;
+    size_t whole = len - len % 3;
+    size_t j = encode_groups(in, whole, output);
+    return j + encode_tail(in + whole, len - whole, output + j);
 }
 
 /* Base64 encode a string for OSC 52 clipboard protocol.
  * Caller must free the returned string.
  * Returns NULL on allocation failure. */
 char *base64_encode(const char *input, size_t len) {
-    size_t output_len = 4 * ((len + 2) / 3);
-    char *output = malloc(output_len + 1);
+    char *output = malloc(BASE64_LEN(len) + 1);
     if (!output) return NULL;
+    output[base64_encode_to(input, len, output)] = '\0';
+    return output;
+}
 
-    size_t i, j;
-    for (i = 0, j = 0; i < len;) {
-        uint32_t octet_a = i < len ? (unsigned char)input[i++] : 0;
-        uint32_t octet_b = i < len ? (unsigned char)input[i++] : 0;
-        uint32_t octet_c = i < len ? (unsigned char)input[i++] : 0;
-        uint32_t triple = (octet_a << 16) + (octet_b << 8) + octet_c;
-
-        output[j++] = base64_table[(triple >> 18) & 0x3F];
-        output[j++] = base64_table[(triple >> 12) & 0x3F];
-        output[j++] = base64_table[(triple >> 6) & 0x3F];
-        output[j++] = base64_table[triple & 0x3F];
+size_t base64_stream_feed(Base64Stream *b64, const char *input, size_t len,
+                          char *output) {
+    const unsigned char *in = (const unsigned char *)input;
+    size_t j = 0;
+    if (b64->ncarry > 0) {
+        /* Complete the group left by the piece before */
+        unsigned char group[3] = { b64->carry[0], b64->carry[1], 0 };
+        int n = b64->ncarry;
+        while (n < 3 && len > 0) {
+            group[n++] = *in++;
+            len--;
+        }
+        if (n < 3) {
+            b64->carry[1] = group[1];
+            b64->ncarry = n;
+            return 0;
+        }
+        fill_pairs();
+        encode_group(group, output);
+        j = 4;
+        b64->ncarry = 0;
     }
+    size_t whole = len - len % 3;
+    j += encode_groups(in, whole, output + j);
+    for (size_t i = whole; i < len; i++) b64->carry[b64->ncarry++] = in[i];
+    return j;
+}
+
+size_t base64_stream_finish(Base64Stream *b64, char *output) {
+    size_t n = encode_tail(b64->carry, (size_t)b64->ncarry, output);
+    b64->ncarry = 0;
+    return n;
+}
 
-    /* Add padding */
-    for (i = 0; i < (3 - len % 3) % 3; i++)
-        output[output_len - 1 - i] = '=';
+/* An OSC 52 sequence written as it is encoded, through 'renderer' or to
+ * stdout */
+typedef struct {
+    Renderer *renderer;     /* With write_raw, or NULL for stdout */
+    Base64Stream b64;
+    char *buf;              /* CLIPBOARD_CHUNK, and room for one feed */
+    size_t len;
+    int status;             /* 0, -1 on a write error, 1 if cancelled */
+} Osc52Stream;
+
+/* Input bytes fed at a time, so one feed cannot overflow the chunk */
+#define OSC52_FEED (CLIPBOARD_CHUNK / 4 * 3)
+
+static void osc52_write(Osc52Stream *out, const char *s, size_t len) {
+    if (out->status) return;
+    int ok = out->renderer
+        ? out->renderer->write_raw(out->renderer, s, len) == 0
+        : terminal_write_all(STDOUT_FILENO, s, len) == 0;
+    if (!ok) out->status = -1;
+}
 
-    output[output_len] = '\0';
-    return output;
+static void osc52_flush(Osc52Stream *out) {
+    osc52_write(out, out->buf, out->len);
+    out->len = 0;
+    if (out->status == 0 && terminal_input_interrupted(STDIN_FILENO))
+        out->status = 1;
 }
 
-/* Copy text to clipboard using renderer abstraction or fallback to OSC-52.
- * This allows different clipboard implementations for different frontends. */
-static int clipboard_copy_text(editor_ctx_t *ctx, const char *text, size_t len) {
-    /* Use renderer if available */
-    if (ctx->renderer && ctx->renderer->clipboard_copy) {
-        return ctx->renderer->clipboard_copy(ctx->renderer, text, len);
+static void osc52_text(Osc52Stream *out, const char *text, size_t len) {
+    while (len > 0 && out->status == 0) {
+        size_t take = len < OSC52_FEED ? len : OSC52_FEED;
+        out->len += base64_stream_feed(&out->b64, text, take, out->buf + out->len);
+        if (out->len >= CLIPBOARD_CHUNK) osc52_flush(out);
+        text += take;
+        len -= take;
     }
+}
 
-    /* Fallback: Direct OSC-52 sequence (terminal-specific)
-     * This works over SSH and doesn't require X11 or platform-specific APIs. */
-    char *encoded = base64_encode(text, len);
-    if (!encoded) return -1;
+/* Normalized selection bounds, the end past the start */
+static void selection_bounds(editor_ctx_t *ctx, int *start_y, int *start_x,
+                             int *end_y, int *end_x) {
+    *start_y = ctx->view.sel_start_y;
+    *start_x = ctx->view.sel_start_x;
+    *end_y = ctx->view.sel_end_y;
+    *end_x = ctx->view.sel_end_x;
 
-    printf("\033]52;c;%s\007", encoded);
-    fflush(stdout);
-    free(encoded);
-    return 0;
+    if (*start_y > *end_y || (*start_y == *end_y && *start_x > *end_x)) {
+        int tmp;
+        tmp = *start_y; *start_y = *end_y; *end_y = tmp;
+        tmp = *start_x; *start_x = *end_x; *end_x = tmp;
+    }
+}
+
+/* The selected part of row 'y' as [*x_start, *x_end), clamped to the row.
+ * Returns its length, 0 or less if none. */
+static int row_slice(editor_ctx_t *ctx, int y, int start_y, int start_x,
+                     int end_y, int end_x, int *x_start, int *x_end) {
+    int size = ctx->model.row[y].size;
+    if (ctx->view.sel_block) {
+        *x_start = start_x < end_x ? start_x : end_x;
+        *x_end = (start_x < end_x ? end_x : start_x) + 1;
+        if (*x_start > size) *x_start = size;
+    } else {
+        *x_start = (y == start_y) ? start_x : 0;
+        *x_end = (y == end_y) ? end_x : size;
+    }
+    if (*x_end > size) *x_end = size;
+    return *x_end - *x_start;
+}
+
+/* Bytes of the text of the current selection */
+static size_t selection_length(editor_ctx_t *ctx) {
+    int start_y, start_x, end_y, end_x, x_start, x_end;
+    selection_bounds(ctx, &start_y, &start_x, &end_y, &end_x);
+    size_t len = 0;
+    for (int y = start_y; y <= end_y && y < ctx->model.numrows; y++) {
+        int n = row_slice(ctx, y, start_y, start_x, end_y, end_x, &x_start, &x_end);
+        if (n > 0) len += (size_t)n;
+        if (y < end_y) len++;
+    }
+    return len;
+}
+
+/* Stream the selection to the terminal in an OSC 52 sequence. Returns 0,
+ * -1 on failure, or 1 if cancelled (the sequence aborted, with CAN, so
+ * the clipboard is left as it was). */
+static int stream_selection_osc52(editor_ctx_t *ctx, Renderer *renderer) {
+    Osc52Stream out = { .renderer = renderer };
+    out.buf = malloc(CLIPBOARD_CHUNK + BASE64_LEN(OSC52_FEED + 2) + 4);
+    if (!out.buf) return -1;
+
+    if (!renderer) fflush(stdout);
+    osc52_write(&out, "\033]52;c;", 7);
+
+    int start_y, start_x, end_y, end_x, x_start, x_end;
+    selection_bounds(ctx, &start_y, &start_x, &end_y, &end_x);
+    for (int y = start_y; y <= end_y && y < ctx->model.numrows && !out.status; y++) {
+        int n = row_slice(ctx, y, start_y, start_x, end_y, end_x, &x_start, &x_end);
+        if (n > 0) osc52_text(&out, ctx->model.row[y].chars + x_start, (size_t)n);
+        if (y < end_y) osc52_text(&out, "\n", 1);
+    }
+    out.len += base64_stream_finish(&out.b64, out.buf + out.len);
+    out.buf[out.len++] = '\007';
+    if (out.status == 0) osc52_write(&out, out.buf, out.len);
+
+    int status = out.status;
+    if (status == 1) {
+        out.status = 0;
+        osc52_write(&out, "\030", 1);
+    }
+    free(out.buf);
+    return status;
 }
 
 /* Copy selected text to clipboard.
- * Uses renderer abstraction if available, otherwise falls back to OSC-52.
+ * Streams it to the terminal when the renderer can write to one (or there
+ * is no renderer: OSC 52 on stdout), otherwise hands the renderer the
+ * text, for frontends with clipboards of their own.
  * Clears the selection after successful copy. */
 void copy_selection_to_clipboard(editor_ctx_t *ctx) {
     if (!ctx->view.sel_active) {
@@ -119,65 +311,34 @@ void copy_selection_to_clipboard(editor_ctx_t *ctx) {
         return;
     }
 
-    /* Ensure start comes before end */
-    int start_y = ctx->view.sel_start_y;
-    int start_x = ctx->view.sel_start_x;
-    int end_y = ctx->view.sel_end_y;
-    int end_x = ctx->view.sel_end_x;
-
-    if (start_y > end_y || (start_y == end_y && start_x > end_x)) {
-        int tmp;
-        tmp = start_y; start_y = end_y; end_y = tmp;
-        tmp = start_x; start_x = end_x; end_x = tmp;
+    size_t text_len = selection_length(ctx);
+    if (clipboard_max && text_len > clipboard_max) {
+        editor_set_status_msg(ctx, "Selection too large to copy: %zu bytes (clipmax=%zu)",
+                              text_len, clipboard_max);
+        return;
     }
 
-    /* Build selected text */
-    char *text = NULL;
-    size_t text_len = 0;
-    size_t text_capacity = 1024;
-    text = malloc(text_capacity);
-    if (!text) return;
-
-    for (int y = start_y; y <= end_y && y < ctx->model.numrows; y++) {
-        int x_start = (y == start_y) ? start_x : 0;
-        int x_end = (y == end_y) ? end_x : ctx->model.row[y].size;
-        if (x_end > ctx->model.row[y].size) x_end = ctx->model.row[y].size;
-
-        int len = x_end - x_start;
-        if (len > 0) {
-            while (text_len + len + 2 > text_capacity) {
-                text_capacity *= 2;
-                char *new_text = realloc(text, text_capacity);
-                if (!new_text) { free(text); return; }
-                text = new_text;
-            }
-            memcpy(text + text_len, ctx->model.row[y].chars + x_start, len);
-            text_len += len;
-        }
-        if (y < end_y) {
-            text[text_len++] = '\n';
-        }
+    Renderer *r = ctx->renderer;
+    int result;
+    if (!r || r->write_raw) {
+        result = stream_selection_osc52(ctx, r);
+    } else {
+        char *text = get_selection_text(ctx);
+        if (!text) return;
+        result = r->clipboard_copy ? r->clipboard_copy(r, text, text_len) : -1;
+        free(text);
     }
-    text[text_len] = '\0';
-
-    /* Copy to clipboard using abstraction */
-    int result = clipboard_copy_text(ctx, text, text_len);
-    free(text);
 
     if (result == 0) {
-        editor_set_status_msg(ctx, "Copied %d bytes to clipboard", (int)text_len);
+        editor_set_status_msg(ctx, "Copied %zu bytes to clipboard", text_len);
         ctx->view.sel_active = 0;  /* Clear selection after copy */
+    } else if (result == 1) {
+        editor_set_status_msg(ctx, "Copy cancelled");
     } else {
         editor_set_status_msg(ctx, "Failed to copy to clipboard");
     }
 }
 
-/* Forward declarations for row operations */
-void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at);
-void editor_row_append_string(editor_ctx_t *ctx, t_erow *row, char *s, size_t len);
-void editor_del_row(editor_ctx_t *ctx, int at);
-void editor_update_row(editor_ctx_t *ctx, t_erow *row);
-
 /* Get selected text as a newly allocated string.
  * Caller must free the returned string.
  * Returns NULL if no selection or allocation failure. */
@@ -186,38 +347,17 @@ char *get_selection_text(editor_ctx_t *ctx) {
         return NULL;
     }
 
-    /* Ensure start comes before end */
-    int start_y = ctx->view.sel_start_y;
-    int start_x = ctx->view.sel_start_x;
-    int end_y = ctx->view.sel_end_y;
-    int end_x = ctx->view.sel_end_x;
-
-    if (start_y > end_y || (start_y == end_y && start_x > end_x)) {
-        int tmp;
-        tmp = start_y; start_y = end_y; end_y = tmp;
-        tmp = start_x; start_x = end_x; end_x = tmp;
-    }
+    int start_y, start_x, end_y, end_x, x_start, x_end;
+    selection_bounds(ctx, &start_y, &start_x, &end_y, &end_x);
 
     /* Build selected text */
-    char *text = NULL;
     size_t text_len = 0;
-    size_t text_capacity = 1024;
-    text = malloc(text_capacity);
+    char *text = malloc(selection_length(ctx) + 1);
     if (!text) return NULL;
 
     for (int y = start_y; y <= end_y && y < ctx->model.numrows; y++) {
-        int x_start = (y == start_y) ? start_x : 0;
-        int x_end = (y == end_y) ? end_x : ctx->model.row[y].size;
-        if (x_end > ctx->model.row[y].size) x_end = ctx->model.row[y].size;
-
-        int len = x_end - x_start;
+        int len = row_slice(ctx, y, start_y, start_x, end_y, end_x, &x_start, &x_end);
         if (len > 0) {
-            while (text_len + len + 2 > text_capacity) {
-                text_capacity *= 2;
-                char *new_text = realloc(text, text_capacity);
-                if (!new_text) { free(text); return NULL; }
-                text = new_text;
-            }
             memcpy(text + text_len, ctx->model.row[y].chars + x_start, len);
             text_len += len;
         }
@@ -230,8 +370,30 @@ char *get_selection_text(editor_ctx_t *ctx) {
     return text;
 }
 
+/* Delete the columns of a visual block from each of its rows: one row
+ * rebuild per row, one undo entry for all */
+static int delete_block(editor_ctx_t *ctx, int start_y, int start_x,
+                        int end_y, int end_x) {
+    undo_rows_t undo = {0};
+    struct abuf line = ABUF_INIT;
+    int deleted = 0, x_start, x_end;
+    for (int y = start_y; y <= end_y && y < ctx->model.numrows; y++) {
+        int len = row_slice(ctx, y, start_y, start_x, end_y, end_x, &x_start, &x_end);
+        if (len <= 0) continue;
+        t_erow *row = &ctx->model.row[y];
+        line.len = 0;
+        terminal_buffer_append(&line, row->chars, x_start);
+        terminal_buffer_append(&line, row->chars + x_end, row->size - x_end);
+        undo_rows_set(&undo, ctx, y, line.b, line.len);
+        deleted += len;
+    }
+    undo_record_replace_rows(ctx, &undo);
+    terminal_buffer_free(&line);
+    return deleted;
+}
+
 /* Delete selected text from the buffer.
- * Records undo operations for each deletion.
+ * Records the deletion for undo as one operation.
  * Clears selection and positions cursor at selection start.
  * Returns number of characters deleted, or 0 if no selection. */
 int delete_selection(editor_ctx_t *ctx) {
@@ -239,101 +401,32 @@ int delete_selection(editor_ctx_t *ctx) {
         return 0;
     }
 
-    /* Normalize selection: ensure start comes before end */
-    int start_y = ctx->view.sel_start_y;
-    int start_x = ctx->view.sel_start_x;
-    int end_y = ctx->view.sel_end_y;
-    int end_x = ctx->view.sel_end_x;
-
-    if (start_y > end_y || (start_y == end_y && start_x > end_x)) {
-        int tmp;
-        tmp = start_y; start_y = end_y; end_y = tmp;
-        tmp = start_x; start_x = end_x; end_x = tmp;
-    }
-
-    /* Bounds checking */
-    if (start_y >= ctx->model.numrows) start_y = ctx->model.numrows - 1;
-    if (end_y >= ctx->model.numrows) end_y = ctx->model.numrows - 1;
+    int start_y, start_x, end_y, end_x;
+    selection_bounds(ctx, &start_y, &start_x, &end_y, &end_x);
     if (start_y < 0) start_y = 0;
-    if (end_y < 0) end_y = 0;
-
-    t_erow *start_row = &ctx->model.row[start_y];
-    t_erow *end_row = &ctx->model.row[end_y];
-
-    if (start_x > start_row->size) start_x = start_row->size;
-    if (end_x > end_row->size) end_x = end_row->size;
-    if (start_x < 0) start_x = 0;
-    if (end_x < 0) end_x = 0;
 
-    int deleted_chars = 0;
+    if (ctx->view.sel_block) {
+        int deleted = delete_block(ctx, start_y, start_x, end_y, end_x);
+        ctx->view.sel_active = 0;
+        ctx->view.sel_block = 0;
+
+        /* Cursor to the block's top left corner */
+        int row = start_y < ctx->model.numrows ? start_y : ctx->model.numrows - 1;
+        int col = start_x < end_x ? start_x : end_x;
+        if (col > ctx->model.row[row].size) col = ctx->model.row[row].size;
+        editor_cursor_to(ctx, row, col);
+        return deleted;
+    }
 
     /* Clear selection before modifying buffer */
     ctx->view.sel_active = 0;
 
-    if (start_y == end_y) {
-        /* Single line selection: delete characters from start_x to end_x */
-        t_erow *row = &ctx->model.row[start_y];
-
-        /* Delete characters from end to start to avoid index shifting issues */
-        for (int i = end_x - 1; i >= start_x; i--) {
-            if (i < row->size) {
-                editor_row_del_char(ctx, row, i);
-                deleted_chars++;
-            }
-        }
-    } else {
-        /* Multi-line selection */
-
-        /* 1. Save text after end_x on end row (will be appended to start row) */
-        char *remaining = NULL;
-        int remaining_len = 0;
-        if (end_x < end_row->size) {
-            remaining_len = end_row->size - end_x;
-            remaining = malloc(remaining_len);
-            if (remaining) {
-                memcpy(remaining, end_row->chars + end_x, remaining_len);
-            }
-        }
-
-        /* 2. Truncate start row to start_x */
-        int chars_removed_start = start_row->size - start_x;
-        start_row->chars[start_x] = '\0';
-        start_row->size = start_x;
-        editor_update_row(ctx, start_row);
-        deleted_chars += chars_removed_start;
-
-        /* 3. Delete middle rows and end row (from end to start to avoid index shifting) */
-        for (int y = end_y; y > start_y; y--) {
-            deleted_chars += ctx->model.row[y].size + 1; /* +1 for newline */
-            editor_del_row(ctx, y);
-        }
-
-        /* 4. Append remaining text from end row to start row */
-        if (remaining && remaining_len > 0) {
-            /* Refresh start_row pointer after possible reallocation */
-            start_row = &ctx->model.row[start_y];
-            editor_row_append_string(ctx, start_row, remaining, remaining_len);
-        }
-        free(remaining);
-    }
+    /* One splice, undone as one; the ends are clamped to the document */
+    int row, col;
+    int deleted_chars = editor_delete_range(ctx, start_y, start_x, end_y,
+                                            end_x, &row, &col);
 
     /* Position cursor at start of deleted region */
-    ctx->view.cy = start_y - ctx->view.rowoff;
-    if (ctx->view.cy < 0) {
-        ctx->view.rowoff = start_y;
-        ctx->view.cy = 0;
-    } else if (ctx->view.cy >= ctx->view.screenrows) {
-        ctx->view.rowoff = start_y - ctx->view.screenrows + 1;
-        ctx->view.cy = ctx->view.screenrows - 1;
-    }
-
-    ctx->view.cx = start_x - ctx->view.coloff;
-    if (ctx->view.cx < 0) {
-        ctx->view.coloff = start_x;
-        ctx->view.cx = 0;
-    }
-
-    ctx->model.dirty++;
-
+    editor_cursor_to(ctx, row, col);
     return deleted_chars;
 }
@@ -11,17 +11,67 @@
 #include "internal.h"
 #include <stddef.h>
 
+/* With view.sel_block, the selection is a visual block: the columns
+ * between the two positions, both included, on each row between them.
+ * Text, copies and deletes take those columns of each row. */
+
 /* Check if a position is within the current selection
  * Returns 1 if selected, 0 otherwise */
 int is_selected(editor_ctx_t *ctx, int row, int col);
 
+/* Get the selected columns of a row as the interval [*start, *end)
+ * (*end is INT_MAX when the selection continues past the line end).
+ * With no selection, the extra cursors (multicursor.h) are given as
+ * one selected column each, the first of each row, so they are drawn.
+ * Returns 1 if any column of the row is selected, 0 otherwise */
+int selection_row_span(editor_ctx_t *ctx, int row, int *start, int *end);
+
 /* Base64 encode a string (for OSC 52 clipboard protocol)
  * Caller must free the returned string
  * Returns NULL on allocation failure */
 char *base64_encode(const char *input, size_t len);
 
+/* Length of the base64 encoding of 'len' bytes, padding included */
+#define BASE64_LEN(len) (4 * (((size_t)(len) + 2) / 3))
+
+/* Base64 encode 'len' bytes into 'output', which has room for
+ * BASE64_LEN(len). Not terminated. Returns the bytes written. */
+size_t base64_encode_to(const char *input, size_t len, char *output);
+
+/* An encoding fed in pieces, of any length, that come out as though
+ * joined: the bytes short of a group of three wait for the next piece */
+typedef struct {
+    unsigned char carry[2];
+    int ncarry;
+} Base64Stream;
+
+/* Encode 'len' more bytes into 'output', which has room for
+ * BASE64_LEN(len + 2). Returns the bytes written. */
+size_t base64_stream_feed(Base64Stream *b64, const char *input, size_t len,
+                          char *output);
+
+/* Encode the bytes left, padded, into 'output' (room for 4). Returns the
+ * bytes written. */
+size_t base64_stream_finish(Base64Stream *b64, char *output);
+
+/* Base64 bytes written to the terminal at a time while copying. Between
+ * writes Ctrl-C cancels the copy. */
+#define CLIPBOARD_CHUNK (64 * 1024)
+
+/* Default of the largest selection copied, in bytes */
+#define CLIPBOARD_MAX_DEFAULT (8 * 1024 * 1024)
+
+/* Largest selection copy_selection_to_clipboard() sends, 0 for no limit
+ * (:set clipmax). Terminals drop or cut OSC 52 sequences past limits of
+ * their own (tmux, screen, hterm), so set it to the terminal's. */
+void selection_set_clipboard_max(size_t bytes);
+size_t selection_get_clipboard_max(void);
+
 /* Copy selected text to clipboard using OSC 52 escape sequence
- * Clears selection after successful copy */
+ * Clears selection after successful copy. Through a renderer that can
+ * write to the terminal (or with none, to stdout), the rows are encoded
+ * straight into the sequence, CLIPBOARD_CHUNK at a time, without a copy
+ * of the text. */
 void copy_selection_to_clipboard(editor_ctx_t *ctx);
 
 /* Get selected text as a newly allocated string
@@ -29,8 +79,9 @@ void copy_selection_to_clipboard(editor_ctx_t *ctx);
  * Returns NULL if no selection or allocation failure */
 char *get_selection_text(editor_ctx_t *ctx);
 
-/* Delete selected text from the buffer
- * Records undo operations for each deletion
+/* Delete selected text from the buffer (of a visual block, its columns
+ * from each row, one rebuild per row)
+ * Records the deletion for undo as one operation
  * Clears selection and positions cursor at selection start
  * Returns number of characters deleted, or 0 if no selection */
 int delete_selection(editor_ctx_t *ctx);
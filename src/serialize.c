@@ -16,18 +16,135 @@
  *     For each row:
  *       size:   4 bytes
  *       data:   size bytes
+ *
+ * Snapshot files are version 2, laid out to be mapped and used in place
+ * (editor_model_map_snapshot()):
+ *   [Header]
+ *     magic:    4 bytes
+ *     version:  2 bytes (2)
+ *     dirty:    1 byte
+ *     reserved: 1 byte (0)
+ *     count:    4 bytes (rows)
+ *   [Filename]
+ *     length:   4 bytes (0 if no filename)
+ *     data:     length bytes, then zeros to a multiple of 8
+ *   [Row offsets]
+ *     count + 1 offsets of 8 bytes: where each row's data starts in the
+ *     file, and where the last one ends
+ *   [Rows]
+ *     For each row: its data and a null byte
+ *
+ * Packed snapshots are version 3: rows in blocks of about
+ * PACK_BLOCK_SIZE bytes, each compressed on its own (see lz.h) and
+ * checked with a CRC-32C, so they are written a block at a time and read
+ * a block per thread:
+ *   [Header]
+ *     magic:    4 bytes
+ *     version:  2 bytes (3)
+ *     dirty:    1 byte
+ *     flags:    1 byte (0)
+ *     count:    4 bytes (rows)
+ *     length:   4 bytes (filename, 0 if none)
+ *   [Filename]
+ *     data:     length bytes
+ *     stale:    4 bytes: model.hl_stale_from, or 0xFFFFFFFF
+ *   [Blocks]
+ *     rows:     4 bytes (0: the end, with zero sizes and CRC)
+ *     raw:      4 bytes (size of the rows)
+ *     packed:   4 bytes (size stored; equal to raw if not compressed)
+ *     crc:      4 bytes (CRC-32C of the rows, as raw)
+ *     data:     packed bytes
+ *     For each row, once unpacked:
+ *       size:   4 bytes
+ *       rsize:  4 bytes (0xFFFFFFFF if no highlight is stored)
+ *       state:  4 bytes: hl_oc, cb_lang, cb_entry, csd_section
+ *       data:   size bytes
+ *       render: rsize bytes, then hl: rsize bytes, if stored
+ *
+ * Checkpoint files are version 4: a version 3 snapshot with 4 in its
+ * header (the base), then deltas, each bringing the text up to the next
+ * checkpoint:
+ *   [Delta]
+ *     magic:    4 bytes
+ *     count:    4 bytes (rows after it)
+ *     runs:     4 bytes
+ *     raw:      4 bytes (size of the rest, once unpacked)
+ *     packed:   4 bytes (size stored; equal to raw if not compressed)
+ *     crc:      4 bytes (CRC-32C of the rest, as raw)
+ *     data:     packed bytes, compressed as a whole. Once unpacked:
+ *       dirty:  4 bytes
+ *       stale:  4 bytes, as in the base
+ *       For each run:
+ *         from:  4 bytes: the run's first row in the text before, its
+ *                rows following in order; 0xFFFFFFFF for rows stored
+ *         count: 4 bytes
+ *       The rows stored, in order, laid out as in a block
+ *
+ * Session files are version 5: the buffers open, with their views and
+ * folds, and no text (that is in their files, or in snapshots beside the
+ * session named here):
+ *   [Header]
+ *     magic:    4 bytes
+ *     version:  2 bytes (5)
+ *     reserved: 2 bytes (0)
+ *     count:    4 bytes (buffers)
+ *     current:  4 bytes (index of the one shown)
+ *   For each buffer:
+ *     path:     4 bytes length (0 if unnamed), then its bytes
+ *     snapshot: 4 bytes length (0 if none), then its bytes
+ *     view:     4 bytes each: row, col, rowoff, coloff
+ *     flags:    4 bytes (SESSION_*)
+ *     undo:     4 bytes (undo_seq)
+ *     hash:     8 bytes (text_hash)
+ *     folds:    4 bytes count, then 4 bytes each: first, last, closed
  */
 
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "serialize.h"
 #include "internal.h"
+#include "lz.h"
+#include "task_pool.h"
+#include "memstats.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <uv.h>
 
 /* Header size: magic (4) + version (2) */
 #define HEADER_SIZE 6
 
+/* Version 2 header before the filename, and the row offsets' alignment */
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_ALIGN 8
+
+/* Row offsets written at a time */
+#define SNAPSHOT_OFFSET_BATCH 512
+
+/* Version 3 header before the filename, and a block's header */
+#define PACK_HEADER_SIZE 16
+#define PACK_BLOCK_HEADER 16
+
+/* Bytes of rows a block is closed at, and each row's header in it */
+#define PACK_BLOCK_SIZE (64 * 1024)
+#define PACK_ROW_HEADER 12
+
+/* rsize of a row stored without its highlight, and no stale row */
+#define PACK_NO_HL 0xFFFFFFFFu
+
+/* Threads unpacking blocks, the calling one included */
+#define PACK_MAX_WORKERS 8
+
 /* Helper: write uint32 little-endian */
 static void write_u32(char *buf, uint32_t val) {
     buf[0] = (char)(val & 0xFF);
@@ -56,6 +173,17 @@ static uint16_t read_u16(const char *buf) {
            ((uint16_t)(unsigned char)buf[1] << 8);
 }
 
+/* Helper: write uint64 little-endian */
+static void write_u64(char *buf, uint64_t val) {
+    write_u32(buf, (uint32_t)(val & 0xFFFFFFFFu));
+    write_u32(buf + 4, (uint32_t)(val >> 32));
+}
+
+/* Helper: read uint64 little-endian */
+static uint64_t read_u64(const char *buf) {
+    return (uint64_t)read_u32(buf) | ((uint64_t)read_u32(buf + 4) << 32);
+}
+
 size_t editor_model_serialized_size(const EditorModel *model) {
     if (!model) return 0;
 
@@ -72,9 +200,9 @@ size_t editor_model_serialized_size(const EditorModel *model) {
 
     /* Rows: count (4) + [size (4) + data] for each */
     size += 4;
-    for (int i = 0; i < model->numrows; i++) {
+    for (int i = 0; i < model_numrows(model); i++) {
         size += 4;  /* row size */
-        size += model->row[i].size;  /* row data */
+        size += model_row(model, i)->size;  /* row data */
     }
 
     return size;
@@ -110,11 +238,11 @@ int editor_model_serialize_to_buf(const EditorModel *model, char *buf, size_t bu
     *p++ = (char)(model->dirty ? 1 : 0);
 
     /* Rows */
-    write_u32(p, (uint32_t)model->numrows);
+    write_u32(p, (uint32_t)model_numrows(model));
     p += 4;
 
-    for (int i = 0; i < model->numrows; i++) {
-        t_erow *row = &model->row[i];
+    for (int i = 0; i < model_numrows(model); i++) {
+        t_erow *row = model_row(model, i);
         write_u32(p, (uint32_t)row->size);
         p += 4;
         if (row->size > 0 && row->chars) {
@@ -146,16 +274,986 @@ int editor_model_serialize(const EditorModel *model, char **out_buf, size_t *out
 
 /* Helper: free existing rows in model */
 static void free_model_rows(EditorModel *model) {
+    model->snap_gen = 0;        /* Rows to come are not a checkpoint's */
+    model->counts_kept = 0;
     if (!model->row) return;
 
-    for (int i = 0; i < model->numrows; i++) {
-        free(model->row[i].chars);
-        free(model->row[i].render);
-        free(model->row[i].hl);
+    /* Drop the arena with the rows, but keep the model using one. */
+    int had_arena = model->arena != NULL;
+    editor_model_free_rows(model);
+    if (had_arena) editor_model_use_arena(model);
+}
+
+/* A version 2 snapshot's header and row offsets, checked */
+typedef struct {
+    const char *data;
+    const char *filename;
+    uint32_t filename_len;
+    int dirty;
+    uint32_t numrows;
+    const char *offsets;        /* numrows + 1 of them */
+} Snapshot;
+
+static size_t snapshot_offsets_at(uint32_t filename_len) {
+    size_t at = SNAPSHOT_HEADER_SIZE + (size_t)filename_len;
+    return (at + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+/* Row 'i' of a checked snapshot */
+static const char *snapshot_row(const Snapshot *snap, uint32_t i, int *size) {
+    uint64_t start = read_u64(snap->offsets + (size_t)i * 8);
+    uint64_t end = read_u64(snap->offsets + (size_t)i * 8 + 8);
+    *size = (int)(end - start - 1);
+    return snap->data + start;
+}
+
+/* Check that 'data' is a version 2 snapshot whose rows are all inside it
+ * and null-terminated. Returns 0, or -1. */
+static int snapshot_parse(const char *data, size_t len, Snapshot *snap) {
+    if (len < SNAPSHOT_HEADER_SIZE) return -1;
+    if (read_u32(data) != LOKI_SERIALIZE_MAGIC) return -1;
+    if (read_u16(data + 4) != LOKI_SNAPSHOT_VERSION) return -1;
+
+    snap->data = data;
+    snap->dirty = data[6] != 0;
+    snap->numrows = read_u32(data + 8);
+    snap->filename_len = read_u32(data + 12);
+    snap->filename = data + SNAPSHOT_HEADER_SIZE;
+    if (snap->numrows >= INT_MAX / sizeof(t_erow) ||
+        (size_t)snap->filename_len > len - SNAPSHOT_HEADER_SIZE)
+        return -1;
+
+    size_t at = snapshot_offsets_at(snap->filename_len);
+    size_t table = ((size_t)snap->numrows + 1) * 8;
+    if (at > len || table > len - at) return -1;
+    snap->offsets = data + at;
+
+    uint64_t prev = at + table;
+    if (read_u64(snap->offsets) != prev) return -1;
+    for (uint32_t i = 1; i <= snap->numrows; i++) {
+        uint64_t end = read_u64(snap->offsets + (size_t)i * 8);
+        if (end <= prev || end > len || end - prev - 1 > INT_MAX ||
+            data[end - 1] != '\0')
+            return -1;
+        prev = end;
+    }
+    return 0;
+}
+
+/* A version 2 snapshot, its rows copied to the heap */
+static int deserialize_snapshot(EditorModel *model, const char *data, size_t len) {
+    Snapshot snap;
+    if (snapshot_parse(data, len, &snap) != 0) return -1;
+
+    char *filename = NULL;
+    if (snap.filename_len > 0) {
+        filename = malloc(snap.filename_len + 1);
+        if (!filename) return -1;
+        memcpy(filename, snap.filename, snap.filename_len);
+        filename[snap.filename_len] = '\0';
+    }
+    free(model->filename);
+    model->filename = filename;
+    model->lang.gen = 0;
+    model->dirty = snap.dirty;
+
+    free_model_rows(model);
+    if (snap.numrows > 0) {
+        model->row = mem_calloc(MEM_TAG_CORE, snap.numrows, sizeof(t_erow));
+        if (!model->row) return -1;
+    }
+    model->numrows = (int)snap.numrows;
+    model->rowcap = (int)snap.numrows;
+    model->hl_stale_from = 0;
+
+    for (uint32_t i = 0; i < snap.numrows; i++) {
+        t_erow *row = &model->row[i];
+        const char *chars = snapshot_row(&snap, i, &row->size);
+        row->chars = malloc((size_t)row->size + 1);
+        if (!row->chars) {
+            free_model_rows(model);
+            return -1;
+        }
+        memcpy(row->chars, chars, (size_t)row->size + 1);
+        row->chars_cap = row->size + 1;
+        row->hl_stale = 1;
+    }
+    return 0;
+}
+
+/* ======================== Packed snapshots ======================== */
+
+static uint32_t crc32c_table[256];
+static uv_once_t crc32c_once = UV_ONCE_INIT;
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+uint32_t snapshot_crc32c(uint32_t crc, const void *data, size_t len) {
+    uv_once(&crc32c_once, crc32c_init);
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = crc32c_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Whether a row's highlight can go with it: fresh, and rendered whole */
+static int row_hl_stored(const t_erow *row) {
+    return !row->hl_stale && row->render && row->hl_buf.hl &&
+           row->render_off == 0 && row->colindex == NULL;
+}
+
+/* The open block of a packed snapshot being written */
+typedef struct {
+    SnapshotWriteFn write;
+    void *opaque;
+    char *raw;
+    size_t raw_len, raw_cap;
+    char *packed;
+    size_t packed_cap;
+    uint32_t rows;
+} PackWriter;
+
+static char *pack_reserve(char **buf, size_t *cap, size_t need) {
+    if (need > *cap) {
+        size_t grown = *cap ? *cap : PACK_BLOCK_SIZE;
+        while (grown < need) grown *= 2;
+        char *p = realloc(*buf, grown);
+        if (!p) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *buf = p;
+        *cap = grown;
+    }
+    return *buf;
+}
+
+/* Compress and write the open block. Returns 0, or -1. */
+static int pack_flush(PackWriter *w) {
+    if (w->rows == 0) return 0;
+    pack_reserve(&w->packed, &w->packed_cap, PACK_BLOCK_HEADER + lz_bound(w->raw_len));
+    size_t len = lz_compress(w->raw, w->raw_len, w->packed + PACK_BLOCK_HEADER);
+    if (len >= w->raw_len) {
+        memcpy(w->packed + PACK_BLOCK_HEADER, w->raw, w->raw_len);
+        len = w->raw_len;
+    }
+    write_u32(w->packed, w->rows);
+    write_u32(w->packed + 4, (uint32_t)w->raw_len);
+    write_u32(w->packed + 8, (uint32_t)len);
+    write_u32(w->packed + 12, snapshot_crc32c(0, w->raw, w->raw_len));
+    w->rows = 0;
+    w->raw_len = 0;
+    return w->write(w->opaque, w->packed, PACK_BLOCK_HEADER + len);
+}
+
+/* Bytes a row takes in a block, and whether its highlight goes too */
+static size_t row_packed_size(const t_erow *row, int *hl) {
+    *hl = row_hl_stored(row);
+    return PACK_ROW_HEADER + (size_t)row->size + (*hl ? 2 * (size_t)row->rsize : 0);
+}
+
+static void row_pack(char *p, const t_erow *row, int hl) {
+    write_u32(p, (uint32_t)row->size);
+    write_u32(p + 4, hl ? (uint32_t)row->rsize : PACK_NO_HL);
+    p[8] = (char)(hl ? row->hl_oc : 0);
+    p[9] = (char)row->cb_lang;
+    p[10] = (char)row->cb_entry;
+    p[11] = (char)row->csd_section;
+    p += PACK_ROW_HEADER;
+    if (row->size > 0) memcpy(p, row->chars, (size_t)row->size);
+    if (hl) {
+        memcpy(p + row->size, row->render, (size_t)row->rsize);
+        editor_row_hl_read(row, 0, row->rsize,
+                           (unsigned char *)p + row->size + row->rsize);
+    }
+}
+
+static int pack_row(PackWriter *w, const t_erow *row) {
+    int hl;
+    size_t need = row_packed_size(row, &hl);
+    if (need > INT_MAX) return -1;
+    if (w->raw_len > INT_MAX - need && pack_flush(w) != 0) return -1;
+    char *p = pack_reserve(&w->raw, &w->raw_cap, w->raw_len + need) + w->raw_len;
+    row_pack(p, row, hl);
+    w->raw_len += need;
+    w->rows++;
+    return w->raw_len >= PACK_BLOCK_SIZE ? pack_flush(w) : 0;
+}
+
+/* A packed snapshot with 'version' in its header: a plain one, or the
+ * base of a checkpoint file */
+static int write_packed(const EditorModel *model, uint16_t version,
+                        SnapshotWriteFn write, void *opaque) {
+    char header[PACK_HEADER_SIZE + 4];
+    uint32_t filename_len = model->filename ? (uint32_t)strlen(model->filename) : 0;
+    int numrows = model_numrows(model);
+    write_u32(header, LOKI_SERIALIZE_MAGIC);
+    write_u16(header + 4, version);
+    header[6] = (char)(model->dirty ? 1 : 0);
+    header[7] = 0;
+    write_u32(header + 8, (uint32_t)numrows);
+    write_u32(header + 12, filename_len);
+    if (write(opaque, header, PACK_HEADER_SIZE) != 0 ||
+        (filename_len && write(opaque, model->filename, filename_len) != 0))
+        return -1;
+    uint32_t stale = model->hl_stale_from < numrows ? (uint32_t)model->hl_stale_from : PACK_NO_HL;
+    write_u32(header, stale);
+    if (write(opaque, header, 4) != 0) return -1;
+
+    PackWriter w = { write, opaque, NULL, 0, 0, NULL, 0, 0 };
+    int result = 0;
+    for (int i = 0; i < numrows && result == 0; i++)
+        result = pack_row(&w, model_row(model, i));
+    if (result == 0) result = pack_flush(&w);
+    if (result == 0) {
+        memset(header, 0, PACK_BLOCK_HEADER);
+        result = write(opaque, header, PACK_BLOCK_HEADER);
+    }
+    free(w.raw);
+    free(w.packed);
+    return result;
+}
+
+int editor_model_write_packed(const EditorModel *model, SnapshotWriteFn write, void *opaque) {
+    if (!model || !write) return -1;
+    return write_packed(model, LOKI_PACK_VERSION, write, opaque);
+}
+
+static int write_file(void *opaque, const void *data, size_t len) {
+    return fwrite(data, 1, len, (FILE *)opaque) == len ? 0 : -1;
+}
+
+int editor_model_save_packed(const EditorModel *model, const char *path) {
+    if (!model || !path) return -1;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    int result = editor_model_write_packed(model, write_file, f);
+    if (fclose(f) != 0) result = -1;
+    return result;
+}
+
+/* A block of a packed snapshot, found by pack_scan() */
+typedef struct {
+    const char *data;
+    uint32_t rows, raw_len, packed_len, crc;
+    uint32_t first;             /* Its first row */
+} PackBlock;
+
+typedef struct {
+    t_erow *rows;
+    PackBlock *blocks;
+    int nblocks;
+    int next;                   /* Next block to unpack */
+    int failed;
+    uv_mutex_t lock;
+} PackJob;
+
+/* Fill 'row' from the bytes at *p, moving *p past them. The row is
+ * zeroed to start with. Returns 0, or -1. */
+static int unpack_row(t_erow *row, const char **pp, const char *end) {
+    const char *p = *pp;
+    if ((size_t)(end - p) < PACK_ROW_HEADER) return -1;
+    uint32_t size = read_u32(p), rsize = read_u32(p + 4);
+    size_t need = size;
+    if (rsize != PACK_NO_HL) need += 2 * (size_t)rsize;
+    if (size > INT_MAX || (rsize != PACK_NO_HL && rsize > INT_MAX) ||
+        need > (size_t)(end - p) - PACK_ROW_HEADER)
+        return -1;
+
+    row->hl_oc = (unsigned char)p[8];
+    row->cb_lang = (unsigned char)p[9];
+    row->cb_entry = (unsigned char)p[10];
+    row->csd_section = (unsigned char)p[11];
+    p += PACK_ROW_HEADER;
+
+    row->chars = malloc((size_t)size + 1);
+    if (!row->chars) return -1;
+    memcpy(row->chars, p, size);
+    row->chars[size] = '\0';
+    row->size = (int)size;
+    row->chars_cap = (int)size + 1;
+    p += size;
+
+    if (rsize == PACK_NO_HL) {
+        row->hl_stale = 1;
+        *pp = p;
+        return 0;
+    }
+    if (rsize == size && memcmp(p, row->chars, size) == 0) {
+        row->render = row->chars;       /* No TABs: see build_row_render() */
+        row->arena_bufs = ROW_BUF_ALIAS;
+    } else {
+        row->render = malloc((size_t)rsize + 1);
+        if (!row->render) return -1;
+        memcpy(row->render, p, rsize);
+        row->render[rsize] = '\0';
+        row->render_cap = (int)rsize + 1;
+    }
+    row->hl_buf.hl = malloc(rsize ? rsize : 1);
+    if (!row->hl_buf.hl) return -1;
+    memcpy(row->hl_buf.hl, p + rsize, rsize);
+    row->rsize = (int)rsize;
+    row->hl_cap = rsize ? (int)rsize : 1;
+    *pp = p + 2 * (size_t)rsize;
+    return 0;
+}
+
+/* Fill the rows of block 'b' from its unpacked bytes. Returns 0, or -1. */
+static int unpack_rows(t_erow *rows, const PackBlock *b, const char *raw) {
+    const char *p = raw, *end = raw + b->raw_len;
+    for (uint32_t i = 0; i < b->rows; i++) {
+        if (unpack_row(&rows[b->first + i], &p, end) != 0) return -1;
+    }
+    return p == end ? 0 : -1;
+}
+
+static void unpack_worker(void *arg) {
+    PackJob *job = arg;
+    char *raw = NULL;
+    size_t raw_cap = 0;
+    for (;;) {
+        uv_mutex_lock(&job->lock);
+        int i = job->failed ? job->nblocks : job->next++;
+        uv_mutex_unlock(&job->lock);
+        if (i >= job->nblocks) break;
+
+        const PackBlock *b = &job->blocks[i];
+        const char *rows = b->data;
+        int ok = 1;
+        if (b->packed_len != b->raw_len) {
+            pack_reserve(&raw, &raw_cap, b->raw_len ? b->raw_len : 1);
+            ok = lz_decompress(b->data, b->packed_len, raw, b->raw_len) == 0;
+            rows = raw;
+        }
+        ok = ok && snapshot_crc32c(0, rows, b->raw_len) == b->crc &&
+             unpack_rows(job->rows, b, rows) == 0;
+        if (!ok) {
+            uv_mutex_lock(&job->lock);
+            job->failed = 1;
+            uv_mutex_unlock(&job->lock);
+        }
+    }
+    free(raw);
+}
+
+/* Find the blocks of a packed snapshot after its header, checking they
+ * hold 'numrows' rows between them. Returns how many, or -1; '*end_at'
+ * is set past the end marker. */
+static int pack_scan(const char *p, const char *end, uint32_t numrows, PackBlock **out,
+                     const char **end_at) {
+    PackBlock *blocks = NULL;
+    int n = 0, cap = 0;
+    uint32_t first = 0;
+    for (;;) {
+        if ((size_t)(end - p) < PACK_BLOCK_HEADER) break;
+        uint32_t rows = read_u32(p);
+        if (rows == 0) {
+            if (first != numrows) break;
+            *out = blocks;
+            *end_at = p + PACK_BLOCK_HEADER;
+            return n;
+        }
+        PackBlock b;
+        b.rows = rows;
+        b.raw_len = read_u32(p + 4);
+        b.packed_len = read_u32(p + 8);
+        b.crc = read_u32(p + 12);
+        b.first = first;
+        b.data = p + PACK_BLOCK_HEADER;
+        p += PACK_BLOCK_HEADER;
+        if (b.packed_len > (size_t)(end - p) || rows > numrows - first ||
+            (b.packed_len > b.raw_len))
+            break;
+        p += b.packed_len;
+        first += rows;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            PackBlock *grown = realloc(blocks, sizeof(*blocks) * (size_t)cap);
+            if (!grown) {
+                perror("Out of memory");
+                exit(1);
+            }
+            blocks = grown;
+        }
+        blocks[n++] = b;
+    }
+    free(blocks);
+    return -1;
+}
+
+/* The text of a packed snapshot, unpacked but not in a model yet */
+typedef struct {
+    t_erow *rows;               /* Rows malloc()ed on their own */
+    uint32_t numrows;
+    char *filename;
+    int dirty;
+    uint32_t stale;             /* hl_stale_from, or PACK_NO_HL */
+} PackedText;
+
+static void free_row_bufs(t_erow *row) {
+    free(row->chars);
+    if (!(row->arena_bufs & ROW_BUF_ALIAS)) free(row->render);
+    free(row->hl_buf.hl);
+}
+
+static void packed_text_free(PackedText *t) {
+    for (uint32_t i = 0; t->rows && i < t->numrows; i++) free_row_bufs(&t->rows[i]);
+    free(t->rows);
+    free(t->filename);
+    t->rows = NULL;
+    t->filename = NULL;
+}
+
+/* Unpack the version 3 layout at 'data', its blocks in parallel. Returns
+ * the bytes it took up, or 0. */
+static size_t unpack_packed(const char *data, size_t len, PackedText *t) {
+    if (len < PACK_HEADER_SIZE) return 0;
+    int dirty = data[6] != 0;
+    uint32_t numrows = read_u32(data + 8);
+    uint32_t filename_len = read_u32(data + 12);
+    if (filename_len > len - PACK_HEADER_SIZE ||
+        len - PACK_HEADER_SIZE - filename_len < 4 || numrows > INT_MAX)
+        return 0;
+    const char *p = data + PACK_HEADER_SIZE + filename_len;
+    uint32_t stale = read_u32(p);
+    p += 4;
+
+    PackBlock *blocks = NULL;
+    const char *end_at = NULL;
+    int nblocks = pack_scan(p, data + len, numrows, &blocks, &end_at);
+    if (nblocks < 0) return 0;
+
+    char *filename = NULL;
+    if (filename_len > 0) {
+        filename = malloc(filename_len + 1);
+        if (!filename) {
+            free(blocks);
+            return 0;
+        }
+        memcpy(filename, data + PACK_HEADER_SIZE, filename_len);
+        filename[filename_len] = '\0';
+    }
+    t_erow *rows = numrows ? calloc(numrows, sizeof(t_erow)) : NULL;
+    if (numrows && !rows) {
+        free(filename);
+        free(blocks);
+        return 0;
+    }
+
+    PackJob job;
+    job.rows = rows;
+    job.blocks = blocks;
+    job.nblocks = nblocks;
+    job.next = 0;
+    job.failed = 0;
+    if (uv_mutex_init(&job.lock) != 0) {
+        free(filename);
+        free(rows);
+        free(blocks);
+        return 0;
+    }
+    int nworkers = task_pool_threads();
+    if (nworkers > nblocks) nworkers = nblocks;
+    if (nworkers > PACK_MAX_WORKERS) nworkers = PACK_MAX_WORKERS;
+
+    /* The calling thread works too, so submit one fewer helper. */
+    Task *tasks[PACK_MAX_WORKERS];
+    int started = 0;
+    while (started < nworkers - 1 &&
+           (tasks[started] = task_submit(unpack_worker, &job, TASK_PRIORITY_HIGH, NULL))) {
+        started++;
+    }
+    unpack_worker(&job);
+    for (int i = 0; i < started; i++) task_wait(tasks[i]);
+    uv_mutex_destroy(&job.lock);
+    free(blocks);
+
+    t->rows = rows;
+    t->numrows = numrows;
+    t->filename = filename;
+    t->dirty = dirty;
+    t->stale = stale;
+    if (job.failed) {
+        packed_text_free(t);
+        return 0;
+    }
+    return (size_t)(end_at - data);
+}
+
+/* Replace the model's text with 't', which it takes */
+static void install_packed(EditorModel *model, PackedText *t) {
+    free(model->filename);
+    model->filename = t->filename;
+    model->lang.gen = 0;
+    model->dirty = t->dirty;
+    free_model_rows(model);
+    model->row = t->rows;
+    mem_adopt(MEM_TAG_CORE, model->row);
+    model->numrows = (int)t->numrows;
+    model->rowcap = (int)t->numrows;
+
+    /* Rows above the first without its highlight kept theirs */
+    uint32_t from = t->stale < t->numrows ? t->stale : t->numrows;
+    for (uint32_t i = 0; i < from; i++) {
+        if (t->rows[i].hl_stale) {
+            from = i;
+            break;
+        }
+    }
+    model->hl_stale_from = from < t->numrows ? (int)from : INT_MAX;
+    t->rows = NULL;
+    t->filename = NULL;
+}
+
+/* A version 3 snapshot, its blocks unpacked in parallel */
+static int deserialize_packed(EditorModel *model, const char *data, size_t len) {
+    PackedText t;
+    if (unpack_packed(data, len, &t) == 0) return -1;
+    install_packed(model, &t);
+    return 0;
+}
+
+/* ======================== Checkpoints ======================== */
+
+/* A delta's header, and the runs after its prefix (dirty, stale) */
+#define DELTA_HEADER 24
+#define DELTA_PREFIX 8
+#define DELTA_RUN 8
+
+/* A run's 'from' for rows stored in the delta */
+#define DELTA_LITERAL 0xFFFFFFFFu
+
+struct SnapshotCheckpoint {
+    char *path;
+    int fd;                     /* Appended to; -1 until a base is written */
+    unsigned long gen;          /* model.snap_gen of the last checkpoint */
+    int numrows;                /* Rows then */
+    char *filename;             /* model.filename then */
+    size_t compact_min;
+    SnapshotCheckpointStats stats;
+
+    /* Compaction, on a thread of its own */
+    uv_thread_t thread;
+    int compacting;
+    atomic_int done;
+    char *tmp;                  /* The file it writes */
+    size_t compact_len;         /* Bytes of 'path' it reads */
+    size_t compact_base;        /* Bytes of the base it wrote */
+    int compact_ok;
+};
+
+/* The runs of rows a delta is made of */
+typedef struct {
+    uint32_t from;              /* Row of the previous text, or DELTA_LITERAL */
+    uint32_t count;
+} DeltaRun;
+
+/* Apply the delta at 'data' to 't'. Returns the bytes it took up, or 0
+ * (and 't' is unchanged) if it is cut short or damaged. */
+static size_t apply_delta(PackedText *t, const char *data, size_t len,
+                          char **scratch, size_t *scratch_cap) {
+    if (len < DELTA_HEADER || read_u32(data) != LOKI_SERIALIZE_MAGIC) return 0;
+    uint32_t numrows = read_u32(data + 4), nruns = read_u32(data + 8);
+    uint32_t raw_len = read_u32(data + 12), packed_len = read_u32(data + 16);
+    uint32_t crc = read_u32(data + 20);
+    if (packed_len > len - DELTA_HEADER || packed_len > raw_len || numrows > INT_MAX)
+        return 0;
+    const char *raw = data + DELTA_HEADER;
+    if (packed_len != raw_len) {
+        pack_reserve(scratch, scratch_cap, raw_len ? raw_len : 1);
+        if (lz_decompress(raw, packed_len, *scratch, raw_len) != 0) return 0;
+        raw = *scratch;
+    }
+    if (snapshot_crc32c(0, raw, raw_len) != crc || raw_len < DELTA_PREFIX ||
+        nruns > (raw_len - DELTA_PREFIX) / DELTA_RUN)
+        return 0;
+
+    /* The runs cover the new rows, and take old ones in order, once */
+    const char *runs = raw + DELTA_PREFIX;
+    uint32_t total = 0, next_from = 0;
+    for (uint32_t i = 0; i < nruns; i++) {
+        uint32_t from = read_u32(runs + i * DELTA_RUN);
+        uint32_t count = read_u32(runs + i * DELTA_RUN + 4);
+        if (count > numrows - total) return 0;
+        if (from != DELTA_LITERAL) {
+            if (from < next_from || from > t->numrows || count > t->numrows - from) return 0;
+            next_from = from + count;
+        }
+        total += count;
+    }
+    if (total != numrows) return 0;
+
+    t_erow *rows = numrows ? calloc(numrows, sizeof(t_erow)) : NULL;
+    if (numrows && !rows) return 0;
+    const char *p = runs + (size_t)nruns * DELTA_RUN, *end = raw + raw_len;
+    uint32_t at = 0;
+    int ok = 1;
+    for (uint32_t i = 0; i < nruns && ok; i++) {
+        uint32_t from = read_u32(runs + i * DELTA_RUN);
+        uint32_t count = read_u32(runs + i * DELTA_RUN + 4);
+        for (uint32_t k = 0; from == DELTA_LITERAL && k < count && ok; k++)
+            ok = unpack_row(&rows[at + k], &p, end) == 0;
+        at += count;
+    }
+    if (!ok || p != end) {
+        for (uint32_t i = 0; i < numrows; i++) free_row_bufs(&rows[i]);
+        free(rows);
+        return 0;
+    }
+
+    /* Rows kept move over. One whose row above is not the one it had may
+     * be highlighted differently now: it is checked again, and marks the
+     * rows below it stale in turn if it changes. */
+    at = 0;
+    for (uint32_t i = 0; i < nruns; i++) {
+        uint32_t from = read_u32(runs + i * DELTA_RUN);
+        uint32_t count = read_u32(runs + i * DELTA_RUN + 4);
+        if (from != DELTA_LITERAL && count > 0) {
+            memcpy(&rows[at], &t->rows[from], sizeof(t_erow) * count);
+            memset(&t->rows[from], 0, sizeof(t_erow) * count);
+            if (at != 0 || from != 0) rows[at].hl_stale = 1;
+        }
+        at += count;
+    }
+    for (uint32_t i = 0; i < t->numrows; i++) free_row_bufs(&t->rows[i]);
+    free(t->rows);
+    t->rows = rows;
+    t->numrows = numrows;
+    t->dirty = read_u32(raw) != 0;
+    t->stale = read_u32(raw + 4);
+    return DELTA_HEADER + packed_len;
+}
+
+/* Unpack a checkpoint file: its base, then every delta up to the first
+ * one cut short or damaged. Returns the bytes applied, or 0. */
+static size_t unpack_checkpoint(const char *data, size_t len, PackedText *t) {
+    size_t used = unpack_packed(data, len, t);
+    if (used == 0) return 0;
+    char *scratch = NULL;
+    size_t scratch_cap = 0, n;
+    while (used < len && (n = apply_delta(t, data + used, len - used, &scratch, &scratch_cap)) > 0)
+        used += n;
+    free(scratch);
+    return used;
+}
+
+static int deserialize_checkpoint(EditorModel *model, const char *data, size_t len) {
+    PackedText t;
+    if (unpack_checkpoint(data, len, &t) == 0) return -1;
+    install_packed(model, &t);
+    return 0;
+}
+
+static int write_fd(void *opaque, const void *data, size_t len) {
+    int fd = *(int *)opaque;
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static off_t file_size(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : -1;
+}
+
+SnapshotCheckpoint *snapshot_checkpoint_open(const char *path) {
+    if (!path) return NULL;
+    SnapshotCheckpoint *cp = calloc(1, sizeof(*cp));
+    if (!cp || !(cp->path = strdup(path))) {
+        perror("Out of memory");
+        exit(1);
+    }
+    cp->fd = -1;
+    cp->compact_min = SNAPSHOT_COMPACT_MIN;
+    return cp;
+}
+
+/* Read 'len' bytes of 'path' into a new buffer */
+static char *read_prefix(const char *path, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    char *buf = malloc(len ? len : 1);
+    size_t got = 0;
+    while (buf && got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+    if (buf && got != len) {
+        free(buf);
+        buf = NULL;
+    }
+    return buf;
+}
+
+/* Replay the file as it was when compaction started, and write it again
+ * as a base alone */
+static void compact_worker(void *arg) {
+    SnapshotCheckpoint *cp = arg;
+    cp->compact_ok = 0;
+    char *data = read_prefix(cp->path, cp->compact_len);
+    PackedText t;
+    if (data && unpack_checkpoint(data, cp->compact_len, &t) == cp->compact_len) {
+        EditorModel model;
+        memset(&model, 0, sizeof(model));
+        model.row = t.rows;
+        model.numrows = (int)t.numrows;
+        model.filename = t.filename;
+        model.dirty = t.dirty;
+        model.hl_stale_from = t.stale < t.numrows ? (int)t.stale : INT_MAX;
+        int fd = open(cp->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            cp->compact_ok = write_packed(&model, LOKI_DELTA_VERSION, write_fd, &fd) == 0;
+            off_t size = file_size(fd);
+            cp->compact_base = size > 0 ? (size_t)size : 0;
+            if (close(fd) != 0) cp->compact_ok = 0;
+        }
+        packed_text_free(&t);
     }
-    free(model->row);
-    model->row = NULL;
-    model->numrows = 0;
+    free(data);
+    atomic_store(&cp->done, 1);
+}
+
+static void start_compaction(SnapshotCheckpoint *cp) {
+    off_t size = file_size(cp->fd);
+    if (size <= 0) return;
+    if (!cp->tmp) {
+        cp->tmp = malloc(strlen(cp->path) + sizeof(".compact"));
+        if (!cp->tmp) {
+            perror("Out of memory");
+            exit(1);
+        }
+        sprintf(cp->tmp, "%s.compact", cp->path);
+    }
+    cp->compact_len = (size_t)size;
+    atomic_store(&cp->done, 0);
+    cp->compacting = 1;
+    if (uv_thread_create(&cp->thread, compact_worker, cp) != 0) cp->compacting = 0;
+}
+
+/* Put a finished compaction in place, after copying into it the deltas
+ * written since it started; with 'wait', wait for it to finish first */
+static void finish_compaction(SnapshotCheckpoint *cp, int wait) {
+    if (!cp->compacting || (!wait && !atomic_load(&cp->done))) return;
+    uv_thread_join(&cp->thread);
+    cp->compacting = 0;
+
+    off_t size = cp->fd >= 0 ? file_size(cp->fd) : -1;
+    int ok = cp->compact_ok && size >= (off_t)cp->compact_len;
+    size_t tail = ok ? (size_t)size - cp->compact_len : 0;
+    if (ok && tail > 0) {
+        char *all = read_prefix(cp->path, (size_t)size);
+        int fd = open(cp->tmp, O_WRONLY | O_APPEND);
+        ok = all && fd >= 0 && write_fd(&fd, all + cp->compact_len, tail) == 0;
+        if (fd >= 0 && close(fd) != 0) ok = 0;
+        free(all);
+    }
+    int fd = -1;
+    if (ok && rename(cp->tmp, cp->path) == 0)
+        fd = open(cp->path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        unlink(cp->tmp);
+        return;
+    }
+    close(cp->fd);
+    cp->fd = fd;
+    cp->stats.base_bytes = cp->compact_base;
+    cp->stats.delta_bytes = tail;
+    cp->stats.compactions++;
+}
+
+/* Write the whole text as the file's base, replacing the file */
+static long long checkpoint_base(SnapshotCheckpoint *cp, const EditorModel *model) {
+    finish_compaction(cp, 1);
+    if (cp->fd >= 0) close(cp->fd);
+    cp->fd = -1;
+
+    char *tmp = malloc(strlen(cp->path) + sizeof(".tmp"));
+    if (!tmp) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sprintf(tmp, "%s.tmp", cp->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write_packed(model, LOKI_DELTA_VERSION, write_fd, &fd) == 0;
+    off_t size = ok ? file_size(fd) : -1;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (!ok || size < 0 || rename(tmp, cp->path) != 0) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    cp->fd = open(cp->path, O_WRONLY | O_APPEND);
+    if (cp->fd < 0) return -1;
+    cp->stats.base_bytes = (size_t)size;
+    cp->stats.delta_bytes = 0;
+    cp->stats.bases++;
+    return (long long)size;
+}
+
+/* Append the rows changed since the last checkpoint, as runs of rows of
+ * the text then and rows stored anew. Returns the bytes written, -1 on
+ * error, or -2 if most rows changed, which a base is better for. */
+static long long checkpoint_delta(SnapshotCheckpoint *cp, const EditorModel *model) {
+    int numrows = model_numrows(model);
+    DeltaRun *runs = NULL;
+    size_t nruns = 0, runs_cap = 0;
+    char *rows = NULL;
+    size_t rows_len = 0, rows_cap = 0;
+    int literal = 0, next_from = 0;
+    for (int i = 0; i < numrows; i++) {
+        const t_erow *row = model_row(model, i);
+        int copy = row->edit_gen <= model->snap_gen && row->snap_row >= next_from &&
+                   row->snap_row < cp->numrows;
+        uint32_t from = copy ? (uint32_t)row->snap_row : DELTA_LITERAL;
+        DeltaRun *last = nruns ? &runs[nruns - 1] : NULL;
+        if (last && (copy ? last->from != DELTA_LITERAL && last->from + last->count == from
+                          : last->from == DELTA_LITERAL)) {
+            last->count++;
+        } else {
+            if (nruns == runs_cap) {
+                runs_cap = runs_cap ? runs_cap * 2 : 64;
+                DeltaRun *grown = realloc(runs, sizeof(*runs) * runs_cap);
+                if (!grown) {
+                    perror("Out of memory");
+                    exit(1);
+                }
+                runs = grown;
+            }
+            runs[nruns].from = from;
+            runs[nruns].count = 1;
+            nruns++;
+        }
+        if (copy) {
+            next_from = row->snap_row + 1;
+            continue;
+        }
+        int hl;
+        size_t need = row_packed_size(row, &hl);
+        row_pack(pack_reserve(&rows, &rows_cap, rows_len + need) + rows_len, row, hl);
+        rows_len += need;
+        literal++;
+    }
+    if (literal > numrows / 2 && literal > 1) {
+        free(runs);
+        free(rows);
+        return -2;
+    }
+
+    /* The prefix, the runs and the rows, compressed as one */
+    size_t raw_len = DELTA_PREFIX + nruns * DELTA_RUN + rows_len;
+    char *raw = NULL, *out = NULL;
+    size_t raw_cap = 0, out_cap = 0;
+    pack_reserve(&raw, &raw_cap, raw_len);
+    write_u32(raw, model->dirty ? 1 : 0);
+    write_u32(raw + 4, model->hl_stale_from < numrows ? (uint32_t)model->hl_stale_from
+                                                      : PACK_NO_HL);
+    for (size_t i = 0; i < nruns; i++) {
+        write_u32(raw + DELTA_PREFIX + i * DELTA_RUN, runs[i].from);
+        write_u32(raw + DELTA_PREFIX + i * DELTA_RUN + 4, runs[i].count);
+    }
+    if (rows_len) memcpy(raw + DELTA_PREFIX + nruns * DELTA_RUN, rows, rows_len);
+    free(runs);
+    free(rows);
+
+    long long result = -1;
+    if (raw_len <= UINT32_MAX / 2) {
+        pack_reserve(&out, &out_cap, DELTA_HEADER + lz_bound(raw_len));
+        size_t len = lz_compress(raw, raw_len, out + DELTA_HEADER);
+        if (len >= raw_len) {
+            memcpy(out + DELTA_HEADER, raw, raw_len);
+            len = raw_len;
+        }
+        write_u32(out, LOKI_SERIALIZE_MAGIC);
+        write_u32(out + 4, (uint32_t)numrows);
+        write_u32(out + 8, (uint32_t)nruns);
+        write_u32(out + 12, (uint32_t)raw_len);
+        write_u32(out + 16, (uint32_t)len);
+        write_u32(out + 20, snapshot_crc32c(0, raw, raw_len));
+        if (write_fd(&cp->fd, out, DELTA_HEADER + len) == 0) {
+            result = (long long)(DELTA_HEADER + len);
+            cp->stats.delta_bytes += DELTA_HEADER + len;
+            cp->stats.deltas++;
+        }
+    }
+    free(raw);
+    free(out);
+    return result;
+}
+
+long long snapshot_checkpoint_write(SnapshotCheckpoint *cp, EditorModel *model) {
+    if (!cp || !model) return -1;
+    finish_compaction(cp, 0);
+    if (model->edit_gen == 0) model->edit_gen = 1;     /* Not from editor_ctx_init() */
+
+    /* A delta only follows on from this file's own last checkpoint */
+    int same_name = (cp->filename == NULL) == (model->filename == NULL) &&
+                    (!cp->filename || strcmp(cp->filename, model->filename) == 0);
+    long long written = -2;
+    if (cp->fd >= 0 && model->snap_gen != 0 && model->snap_gen == cp->gen && same_name)
+        written = checkpoint_delta(cp, model);
+    if (written == -2) written = checkpoint_base(cp, model);
+    if (written < 0) {
+        /* Start again from a base next time */
+        if (cp->fd >= 0) close(cp->fd);
+        cp->fd = -1;
+        return -1;
+    }
+
+    int numrows = model_numrows(model);
+    for (int i = 0; i < numrows; i++) model_row(model, i)->snap_row = i;
+    model->snap_gen = model->edit_gen++;
+    cp->gen = model->snap_gen;
+    cp->numrows = numrows;
+    if (!same_name) {
+        free(cp->filename);
+        cp->filename = model->filename ? strdup(model->filename) : NULL;
+    }
+    cp->stats.last_bytes = (size_t)written;
+
+    if (!cp->compacting && cp->stats.delta_bytes > cp->stats.base_bytes &&
+        cp->stats.delta_bytes >= cp->compact_min)
+        start_compaction(cp);
+    return written;
+}
+
+void snapshot_checkpoint_set_compact_min(SnapshotCheckpoint *cp, size_t bytes) {
+    if (cp) cp->compact_min = bytes;
+}
+
+void snapshot_checkpoint_get_stats(SnapshotCheckpoint *cp, SnapshotCheckpointStats *stats) {
+    finish_compaction(cp, 0);
+    *stats = cp->stats;
+    stats->compacting = cp->compacting;
+}
+
+void snapshot_checkpoint_close(SnapshotCheckpoint *cp) {
+    if (!cp) return;
+    finish_compaction(cp, 1);
+    if (cp->fd >= 0) close(cp->fd);
+    free(cp->tmp);
+    free(cp->filename);
+    free(cp->path);
+    free(cp);
 }
 
 int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
@@ -173,6 +1271,9 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
     /* Check version */
     uint16_t version = read_u16(p);
     p += 2;
+    if (version == LOKI_SNAPSHOT_VERSION) return deserialize_snapshot(model, data, len);
+    if (version == LOKI_PACK_VERSION) return deserialize_packed(model, data, len);
+    if (version == LOKI_DELTA_VERSION) return deserialize_checkpoint(model, data, len);
     if (version > LOKI_SERIALIZE_VERSION) return -1;  /* Future version */
 
     /* Read filename */
@@ -185,6 +1286,7 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
     /* Free existing filename */
     free(model->filename);
     model->filename = NULL;
+    model->lang.gen = 0;
 
     if (filename_len > 0) {
         model->filename = malloc(filename_len + 1);
@@ -208,10 +1310,11 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
 
     /* Allocate new rows */
     if (numrows > 0) {
-        model->row = calloc(numrows, sizeof(t_erow));
+        model->row = mem_calloc(MEM_TAG_CORE, numrows, sizeof(t_erow));
         if (!model->row) return -1;
     }
     model->numrows = (int)numrows;
+    model->rowcap = (int)numrows;
 
     /* Read each row */
     for (uint32_t i = 0; i < numrows; i++) {
@@ -229,11 +1332,10 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
         }
 
         t_erow *row = &model->row[i];
-        row->idx = (int)i;
         row->size = (int)row_size;
         row->rsize = 0;
         row->render = NULL;
-        row->hl = NULL;
+        row->hl_buf.hl = NULL;
         row->hl_oc = 0;
         row->cb_lang = 0;
         row->csd_section = 0;
@@ -246,6 +1348,7 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
             }
             memcpy(row->chars, p, row_size);
             row->chars[row_size] = '\0';
+            row->chars_cap = (int)row_size + 1;
             p += row_size;
         } else {
             row->chars = malloc(1);
@@ -254,33 +1357,63 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len) {
                 return -1;
             }
             row->chars[0] = '\0';
+            row->chars_cap = 1;
         }
     }
 
     return 0;
 }
 
-int editor_model_save_snapshot(const EditorModel *model, const char *path) {
-    if (!model || !path) return -1;
-
-    char *buf = NULL;
-    size_t len = 0;
+/* Write 'model' to 'f' as a version 2 snapshot. Returns 0, or -1. */
+static int write_snapshot(const EditorModel *model, FILE *f) {
+    char header[SNAPSHOT_HEADER_SIZE], zeros[SNAPSHOT_ALIGN] = {0};
+    uint32_t filename_len = model->filename ? (uint32_t)strlen(model->filename) : 0;
+    int numrows = model_numrows(model);
 
-    if (editor_model_serialize(model, &buf, &len) != 0) {
+    write_u32(header, LOKI_SERIALIZE_MAGIC);
+    write_u16(header + 4, LOKI_SNAPSHOT_VERSION);
+    header[6] = (char)(model->dirty ? 1 : 0);
+    header[7] = 0;
+    write_u32(header + 8, (uint32_t)numrows);
+    write_u32(header + 12, filename_len);
+    size_t at = snapshot_offsets_at(filename_len);
+    size_t pad = at - SNAPSHOT_HEADER_SIZE - filename_len;
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+        fwrite(model->filename ? model->filename : "", 1, filename_len, f) != filename_len ||
+        fwrite(zeros, 1, pad, f) != pad)
         return -1;
+
+    /* Offsets, in batches */
+    char batch[SNAPSHOT_OFFSET_BATCH * 8];
+    uint64_t off = at + ((uint64_t)numrows + 1) * 8;
+    int n = 0;
+    for (int i = 0; i <= numrows; i++) {
+        write_u64(batch + (size_t)n * 8, off);
+        if (i < numrows) off += (uint64_t)model_row(model, i)->size + 1;
+        if (++n == SNAPSHOT_OFFSET_BATCH || i == numrows) {
+            if (fwrite(batch, 8, (size_t)n, f) != (size_t)n) return -1;
+            n = 0;
+        }
     }
 
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        free(buf);
-        return -1;
+    for (int i = 0; i < numrows; i++) {
+        t_erow *row = model_row(model, i);
+        if (row->size > 0 && fwrite(row->chars, 1, (size_t)row->size, f) != (size_t)row->size)
+            return -1;
+        if (fputc('\0', f) == EOF) return -1;
     }
+    return 0;
+}
 
-    size_t written = fwrite(buf, 1, len, f);
-    fclose(f);
-    free(buf);
+int editor_model_save_snapshot(const EditorModel *model, const char *path) {
+    if (!model || !path) return -1;
 
-    return (written == len) ? 0 : -1;
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    int result = write_snapshot(model, f);
+    if (fclose(f) != 0) result = -1;
+    return result;
 }
 
 int editor_model_load_snapshot(EditorModel *model, const char *path) {
@@ -320,3 +1453,208 @@ int editor_model_load_snapshot(EditorModel *model, const char *path) {
 
     return result;
 }
+
+int editor_model_map_snapshot(EditorModel *model, const char *path) {
+    if (!model || !path) return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return editor_model_load_snapshot(model, path);
+
+    Snapshot snap;
+    if (snapshot_parse(map, len, &snap) != 0) {
+        /* Version 1, or not a snapshot at all */
+        int result = editor_model_deserialize(model, map, len);
+        munmap(map, len);
+        return result;
+    }
+
+    char *filename = NULL;
+    if (snap.filename_len > 0) {
+        filename = malloc(snap.filename_len + 1);
+        if (!filename) {
+            munmap(map, len);
+            return -1;
+        }
+        memcpy(filename, snap.filename, snap.filename_len);
+        filename[snap.filename_len] = '\0';
+    }
+
+    t_erow *rows = snap.numrows ? calloc(snap.numrows, sizeof(t_erow)) : NULL;
+    if (snap.numrows && !rows) {
+        free(filename);
+        munmap(map, len);
+        return -1;
+    }
+
+    free(model->filename);
+    model->filename = filename;
+    model->lang.gen = 0;
+    model->dirty = snap.dirty;
+    free_model_rows(model);
+    model->row = rows;
+    model->numrows = (int)snap.numrows;
+    model->rowcap = (int)snap.numrows;
+    model->hl_stale_from = 0;
+
+    for (uint32_t i = 0; i < snap.numrows; i++) {
+        t_erow *row = &rows[i];
+        row->chars = (char *)snapshot_row(&snap, i, &row->size);
+        row->arena_bufs = ROW_BUF_MAPPED;
+        row->hl_stale = 1;
+    }
+    if (snap.numrows) {
+        model->row_map = editor_row_map_new(map, len);
+    } else {
+        munmap(map, len);
+    }
+    return 0;
+}
+
+/* ======================== Sessions ======================== */
+
+/* Header of a session: magic, version, reserved, count, current */
+#define SESSION_HEADER_SIZE 16
+
+/* A buffer's fixed fields: two lengths, view, flags, undo, hash, folds */
+#define SESSION_BUFFER_SIZE 44
+
+static size_t str_len(const char *s) {
+    return s ? strlen(s) : 0;
+}
+
+static char *put_str(char *p, const char *s) {
+    size_t len = str_len(s);
+    write_u32(p, (uint32_t)len);
+    if (len) memcpy(p + 4, s, len);
+    return p + 4 + len;
+}
+
+int session_serialize(const SessionState *state, char **out_buf, size_t *out_len) {
+    if (!state || !out_buf || !out_len) return -1;
+
+    size_t size = SESSION_HEADER_SIZE;
+    for (int i = 0; i < state->count; i++) {
+        const SessionBuffer *b = &state->buf[i];
+        size += SESSION_BUFFER_SIZE + str_len(b->path) + str_len(b->snapshot) +
+                (size_t)b->nfolds * 12;
+    }
+    char *buf = malloc(size);
+    if (!buf) return -1;
+
+    write_u32(buf, LOKI_SERIALIZE_MAGIC);
+    write_u16(buf + 4, LOKI_SESSION_VERSION);
+    write_u16(buf + 6, 0);
+    write_u32(buf + 8, (uint32_t)state->count);
+    write_u32(buf + 12, (uint32_t)state->current);
+    char *p = buf + SESSION_HEADER_SIZE;
+    for (int i = 0; i < state->count; i++) {
+        const SessionBuffer *b = &state->buf[i];
+        p = put_str(p, b->path);
+        p = put_str(p, b->snapshot);
+        write_u32(p, (uint32_t)b->row);
+        write_u32(p + 4, (uint32_t)b->col);
+        write_u32(p + 8, (uint32_t)b->rowoff);
+        write_u32(p + 12, (uint32_t)b->coloff);
+        write_u32(p + 16, (uint32_t)b->flags);
+        write_u32(p + 20, (uint32_t)b->undo_seq);
+        write_u64(p + 24, b->text_hash);
+        write_u32(p + 32, (uint32_t)b->nfolds);
+        p += 36;
+        for (int f = 0; f < b->nfolds; f++) {
+            write_u32(p, (uint32_t)b->folds[f].first);
+            write_u32(p + 4, (uint32_t)b->folds[f].last);
+            write_u32(p + 8, (uint32_t)b->folds[f].closed);
+            p += 12;
+        }
+    }
+
+    *out_buf = buf;
+    *out_len = size;
+    return 0;
+}
+
+/* A string of the session at *p, moving *p past it; *s is NULL if empty.
+ * Returns 0, or -1 if it runs past 'end' or memory runs out. */
+static int get_str(const char **p, const char *end, char **s) {
+    *s = NULL;
+    if (end - *p < 4) return -1;
+    uint32_t len = read_u32(*p);
+    *p += 4;
+    if ((size_t)(end - *p) < len) return -1;
+    if (len == 0) return 0;
+    *s = malloc((size_t)len + 1);
+    if (!*s) return -1;
+    memcpy(*s, *p, len);
+    (*s)[len] = '\0';
+    *p += len;
+    return 0;
+}
+
+int session_deserialize(SessionState *state, const char *data, size_t len) {
+    if (!state || !data) return -1;
+    memset(state, 0, sizeof(*state));
+    if (len < SESSION_HEADER_SIZE) return -1;
+    if (read_u32(data) != LOKI_SERIALIZE_MAGIC) return -1;
+    if (read_u16(data + 4) != LOKI_SESSION_VERSION) return -1;
+
+    uint32_t count = read_u32(data + 8);
+    uint32_t current = read_u32(data + 12);
+    /* Each buffer takes SESSION_BUFFER_SIZE bytes at least */
+    if (count > (len - SESSION_HEADER_SIZE) / SESSION_BUFFER_SIZE) return -1;
+    if (count > 0 && current >= count) return -1;
+    if (count > 0 && !(state->buf = calloc(count, sizeof(SessionBuffer)))) return -1;
+    state->current = (int)current;
+
+    const char *p = data + SESSION_HEADER_SIZE, *end = data + len;
+    for (uint32_t i = 0; i < count; i++) {
+        SessionBuffer *b = &state->buf[i];
+        state->count++;
+        if (get_str(&p, end, &b->path) != 0 || get_str(&p, end, &b->snapshot) != 0)
+            goto fail;
+        if (end - p < 36) goto fail;
+        b->row = (int)read_u32(p);
+        b->col = (int)read_u32(p + 4);
+        b->rowoff = (int)read_u32(p + 8);
+        b->coloff = (int)read_u32(p + 12);
+        b->flags = (int)read_u32(p + 16);
+        b->undo_seq = (int)read_u32(p + 20);
+        b->text_hash = read_u64(p + 24);
+        uint32_t nfolds = read_u32(p + 32);
+        p += 36;
+        if (nfolds > (size_t)(end - p) / 12) goto fail;
+        if (nfolds > 0 && !(b->folds = malloc(nfolds * sizeof(SessionFold))))
+            goto fail;
+        b->nfolds = (int)nfolds;
+        for (uint32_t f = 0; f < nfolds; f++) {
+            b->folds[f].first = (int)read_u32(p);
+            b->folds[f].last = (int)read_u32(p + 4);
+            b->folds[f].closed = (int)read_u32(p + 8);
+            p += 12;
+        }
+    }
+    return 0;
+
+fail:
+    session_state_free(state);
+    return -1;
+}
+
+void session_state_free(SessionState *state) {
+    if (!state) return;
+    for (int i = 0; i < state->count; i++) {
+        free(state->buf[i].path);
+        free(state->buf[i].snapshot);
+        free(state->buf[i].folds);
+    }
+    free(state->buf);
+    memset(state, 0, sizeof(*state));
+}
@@ -13,18 +13,44 @@
  * - Filename: length (4 bytes) + data
  * - Flags: dirty (1 byte)
  * - Rows: count (4 bytes) + [size (4 bytes) + data] for each row
+ *
+ * Snapshot files use version 2 of the format, with a table of row
+ * offsets, so they can be mapped and their rows used in place
+ * (editor_model_map_snapshot()). Packed snapshots, version 3, keep rows
+ * in compressed, checksummed blocks along with their highlight, and are
+ * written a block at a time (editor_model_write_packed()). Checkpoint
+ * files, version 4, are a packed base followed by deltas holding only the
+ * rows changed since the checkpoint before, for saving often (see
+ * snapshot_checkpoint_write()). See serialize.c for the layouts.
  */
 
 #ifndef LOKI_SERIALIZE_H
 #define LOKI_SERIALIZE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "loki/core.h"  /* For editor_ctx_t */
 #include "internal.h"   /* For EditorModel */
 
 /* Serialization format version */
 #define LOKI_SERIALIZE_VERSION 1
 
+/* Snapshot file format version (row offset table, mappable) */
+#define LOKI_SNAPSHOT_VERSION 2
+
+/* Packed snapshot format version (compressed, checksummed blocks) */
+#define LOKI_PACK_VERSION 3
+
+/* Checkpoint file format version (a packed base, then deltas) */
+#define LOKI_DELTA_VERSION 4
+
+/* Bytes of deltas past which a checkpoint file is compacted by default,
+ * once they also outgrow its base */
+#define SNAPSHOT_COMPACT_MIN (256 * 1024)
+
+/* Session file format version (open buffers, their views and folds) */
+#define LOKI_SESSION_VERSION 5
+
 /* Magic bytes: "LOKI" */
 #define LOKI_SERIALIZE_MAGIC 0x494B4F4C
 
@@ -44,7 +70,8 @@ int editor_model_serialize(const EditorModel *model, char **out_buf, size_t *out
 /**
  * Deserialize EditorModel from a binary buffer.
  *
- * Restores document content into the model. The model should be
+ * Restores document content into the model, from any version of the
+ * format. The model should be
  * initialized (via editor_ctx_init) before calling this function.
  * Existing rows in the model will be freed and replaced.
  *
@@ -58,7 +85,8 @@ int editor_model_deserialize(EditorModel *model, const char *data, size_t len);
 /**
  * Save EditorModel to a snapshot file.
  *
- * Convenience wrapper that serializes and writes to file.
+ * Writes the model in the version 2 format, row by row, without
+ * serializing it in memory first.
  *
  * @param model Source model to save
  * @param path File path to write
@@ -78,6 +106,130 @@ int editor_model_save_snapshot(const EditorModel *model, const char *path);
  */
 int editor_model_load_snapshot(EditorModel *model, const char *path);
 
+/**
+ * Map a snapshot file and use its rows in place.
+ *
+ * The rows of a version 2 snapshot point into a read-only mapping of the
+ * file held by the model (ROW_BUF_MAPPED), and are copied one at a time
+ * as they are edited; the mapping goes with editor_model_free_rows() and
+ * the last share of its rows (editor_row_share()). Its
+ * pages are the page cache's, so restoring costs the row table, not a
+ * copy of the text. Other files are read as editor_model_load_snapshot()
+ * does. The model should be initialized, and freed with
+ * editor_model_free_rows() rather than by freeing each row.
+ *
+ * @param model Destination model (must be initialized)
+ * @param path File path to map
+ * @return 0 on success, -1 on error
+ */
+int editor_model_map_snapshot(EditorModel *model, const char *path);
+
+/**
+ * Where editor_model_write_packed() sends its output: 'len' bytes at
+ * 'data', to be written in order. Returns 0, or -1 to stop writing.
+ */
+typedef int (*SnapshotWriteFn)(void *opaque, const void *data, size_t len);
+
+/**
+ * Write EditorModel as a packed snapshot.
+ *
+ * Rows go out in blocks of about 64KB, each compressed and checksummed
+ * on its own, so memory use is a block's rather than the document's.
+ * Rows whose highlight is up to date carry it, and come back without
+ * being highlighted again. Undo history is not included; it is kept by
+ * the undo journal (see undo_journal.h). Read with
+ * editor_model_deserialize() or editor_model_load_snapshot(), which
+ * unpack the blocks on several threads.
+ *
+ * @param model Source model to write
+ * @param write Called with each piece of output, in order
+ * @param opaque Passed to 'write'
+ * @return 0 on success, -1 on error (or if 'write' failed)
+ */
+int editor_model_write_packed(const EditorModel *model, SnapshotWriteFn write, void *opaque);
+
+/**
+ * Save EditorModel to a packed snapshot file.
+ *
+ * @param model Source model to save
+ * @param path File path to write
+ * @return 0 on success, -1 on error
+ */
+int editor_model_save_packed(const EditorModel *model, const char *path);
+
+/**
+ * CRC-32C (Castagnoli) of 'len' bytes, as packed snapshots check their
+ * blocks with. Pass 0 as 'crc' to start, or a previous result to go on.
+ */
+uint32_t snapshot_crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * A checkpoint file being written: see snapshot_checkpoint_write().
+ */
+typedef struct SnapshotCheckpoint SnapshotCheckpoint;
+
+typedef struct SnapshotCheckpointStats {
+    size_t base_bytes;          /* The file's base */
+    size_t delta_bytes;         /* The deltas after it */
+    unsigned long bases;        /* Bases written */
+    unsigned long deltas;       /* Deltas written */
+    unsigned long compactions;  /* Compactions put in place */
+    size_t last_bytes;          /* Written by the last checkpoint */
+    int compacting;             /* A compaction is under way */
+} SnapshotCheckpointStats;
+
+/**
+ * Start checkpointing to 'path'. Nothing is written until the first
+ * snapshot_checkpoint_write().
+ *
+ * @param path File to write
+ * @return The checkpoint, for snapshot_checkpoint_close(), or NULL
+ */
+SnapshotCheckpoint *snapshot_checkpoint_open(const char *path);
+
+/**
+ * Save EditorModel to the checkpoint file.
+ *
+ * The first checkpoint writes the whole text as a packed base (in a
+ * temporary file renamed over 'path'). Later ones append a delta: the
+ * rows whose text changed since the checkpoint before, stored anew, and
+ * runs of the rows kept, by their index then, so a checkpoint costs in
+ * proportion to the edits made since. Rows are told apart by the
+ * model's edit generations: each checkpoint bumps model.edit_gen, so
+ * the model is written. A base is written instead if the rows were
+ * replaced since (by loading a file, say), the model is another's, or
+ * most rows changed.
+ *
+ * Once the deltas outgrow both the base and the minimum (see
+ * snapshot_checkpoint_set_compact_min()), a thread replays the file and
+ * writes it again as a base alone; a later call puts it in place, with
+ * the deltas written meanwhile after it. Read the file back with
+ * editor_model_load_snapshot(), which applies the deltas, up to the
+ * first one cut short or damaged.
+ *
+ * @param cp Checkpoint from snapshot_checkpoint_open()
+ * @param model Source model to save
+ * @return Bytes written, or -1 on error (the next call writes a base)
+ */
+long long snapshot_checkpoint_write(SnapshotCheckpoint *cp, EditorModel *model);
+
+/**
+ * Set the bytes of deltas a checkpoint file must reach before it is
+ * compacted (SNAPSHOT_COMPACT_MIN by default).
+ */
+void snapshot_checkpoint_set_compact_min(SnapshotCheckpoint *cp, size_t bytes);
+
+/**
+ * Get the sizes and counts of a checkpoint file's writes.
+ */
+void snapshot_checkpoint_get_stats(SnapshotCheckpoint *cp, SnapshotCheckpointStats *stats);
+
+/**
+ * Stop checkpointing, after putting a compaction under way in place.
+ * The file is kept.
+ */
+void snapshot_checkpoint_close(SnapshotCheckpoint *cp);
+
 /**
  * Get the serialized size of an EditorModel without allocating.
  *
@@ -101,4 +253,61 @@ size_t editor_model_serialized_size(const EditorModel *model);
  */
 int editor_model_serialize_to_buf(const EditorModel *model, char *buf, size_t buf_len);
 
+/* A fold of a buffer in a session */
+typedef struct SessionFold {
+    int first, last;
+    int closed;
+} SessionFold;
+
+/* SessionBuffer flags */
+#define SESSION_LINE_NUMBERS 1
+#define SESSION_WORD_WRAP 2
+#define SESSION_MODIFIED 4      /* Had unsaved changes */
+#define SESSION_LAZY 8          /* row is a line of a file opened lazily */
+
+/* A buffer of a session: what it shows, and where */
+typedef struct SessionBuffer {
+    char *path;                 /* Its file (NULL: an unnamed buffer) */
+    char *snapshot;             /* Snapshot of its rows (NULL: none) */
+    int row, col;               /* Cursor, in the document */
+    int rowoff, coloff;         /* Scroll position */
+    int flags;                  /* SESSION_* */
+    int undo_seq;               /* undo_state_seq() of its text */
+    uint64_t text_hash;         /* Hash of its rows (modified buffers) */
+    SessionFold *folds;
+    int nfolds;
+} SessionBuffer;
+
+/* The buffers of a session, in order, and the one shown */
+typedef struct SessionState {
+    SessionBuffer *buf;
+    int count;
+    int current;
+} SessionState;
+
+/**
+ * Serialize a session to a binary buffer (version LOKI_SESSION_VERSION).
+ *
+ * @param state Session to serialize
+ * @param out_buf Output buffer (allocated by this function, caller must free)
+ * @param out_len Output buffer length
+ * @return 0 on success, -1 on error
+ */
+int session_serialize(const SessionState *state, char **out_buf, size_t *out_len);
+
+/**
+ * Deserialize a session written by session_serialize().
+ *
+ * @param state Destination, filled in; release with session_state_free()
+ * @param data Input buffer
+ * @param len Input buffer length
+ * @return 0 on success, -1 on error (invalid format, version mismatch, etc.)
+ */
+int session_deserialize(SessionState *state, const char *data, size_t len);
+
+/**
+ * Free what a session holds, leaving it empty. Safe on an empty one.
+ */
+void session_state_free(SessionState *state);
+
 #endif /* LOKI_SERIALIZE_H */
@@ -6,6 +6,7 @@
 
 #include "session.h"
 #include "internal.h"
+#include "lazy.h"
 #include "selection.h"
 #include "buffers.h"
 #include "terminal.h"
@@ -13,133 +14,255 @@
 #include "lang_bridge.h"
 #include "loki/lua.h"
 #include "syntax.h"
+#include "trace.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 
-/* Maximum render segments per row */
-#define MAX_SEGMENTS_PER_ROW 256
-
 /* ======================= Internal Structure ================================ */
 
+/* A row view the session keeps across snapshots, with the room its
+ * buffers have */
+typedef struct {
+    EditorRowView view;
+    int seg_cap;
+    size_t text_cap;
+} CachedRow;
+
 struct EditorSession {
     editor_ctx_t ctx;       /* Editor context (owned) */
     int initialized;        /* Initialization flag */
     int should_quit;        /* Quit flag set by event handling */
+    ViewFrame frame;        /* Last snapshot taken */
+    CachedRow *cache;       /* Row views of the last snapshot (owned) */
+    int cache_rows;         /* Entries of cache in use */
+    CachedRow *spare;       /* Row views to build the next snapshot into,
+                               swapped with cache once it is taken */
+    int rows_cap;           /* Entries in cache and in spare */
+    RenderSegment *segs;    /* Scratch segments, reused across rows */
+    int seg_cap;
+    EditorViewModel *vm;    /* Frame filled by editor_session_frame() */
 };
 
-/* ======================= Helper Functions ================================== */
-
-/* Duplicate a string, returns NULL if input is NULL */
-static char *safe_strdup(const char *s) {
-    if (!s) return NULL;
-    return strdup(s);
+/* ======================= Frame Memory ====================================== */
+
+/* Everything a view model points to comes from its FrameStore, handed out
+ * in order from a few blocks and taken back all at once when the model is
+ * filled again. A fill that needed more than one block leaves a single
+ * block as large as all of them for the next, so a model refilled with
+ * frames of about the same size soon stops allocating. */
+typedef struct FrameBlock {
+    struct FrameBlock *next;    /* Older blocks */
+    size_t cap;
+    size_t used;
+    char data[];
+} FrameBlock;
+
+typedef struct FrameStore {
+    FrameBlock *head;           /* Block being handed out */
+} FrameStore;
+
+#define FRAME_BLOCK_MIN 4096
+#define FRAME_ALIGN 8
+
+static FrameBlock *frame_block_new(size_t cap) {
+    FrameBlock *b = malloc(sizeof(FrameBlock) + cap);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->cap = cap;
+    b->used = 0;
+    return b;
 }
 
-/* Build render segments for a row (same logic as in core.c) */
-static int build_row_segments(editor_ctx_t *ctx, t_erow *row, int row_idx,
-                              int coloff, int max_cols,
-                              RenderSegment *segments) {
-    if (!row || row->rsize <= coloff) return 0;
-
-    int len = row->rsize - coloff;
-    if (len > max_cols) len = max_cols;
-    if (len <= 0) return 0;
-
-    char *c = row->render + coloff;
-    unsigned char *hl = row->hl + coloff;
-    int seg_count = 0;
-
-    int seg_start = 0;
-    int current_hl = hl[0];
-    int current_selected = is_selected(ctx, row_idx, coloff);
-
-    for (int j = 1; j <= len && seg_count < MAX_SEGMENTS_PER_ROW - 1; j++) {
-        int next_hl = (j < len) ? hl[j] : -1;
-        int next_selected = (j < len) ? is_selected(ctx, row_idx, coloff + j) : 0;
-
-        if (j == len || next_hl != current_hl || next_selected != current_selected) {
-            segments[seg_count].text = c + seg_start;
-            segments[seg_count].len = j - seg_start;
-            segments[seg_count].hl_type = hl_const_to_type(current_hl);
-            segments[seg_count].selected = current_selected;
-            seg_count++;
-            seg_start = j;
-            current_hl = next_hl;
-            current_selected = next_selected;
-        }
+static void frame_store_free(FrameStore *fs) {
+    if (!fs) return;
+    FrameBlock *b = fs->head;
+    while (b) {
+        FrameBlock *next = b->next;
+        free(b);
+        b = next;
     }
-
-    return seg_count;
+    free(fs);
 }
 
-/* Deep copy row view with owned segment data */
-static int copy_row_view(EditorRowView *dest, editor_ctx_t *ctx, int y,
-                         int gutter_width, int text_cols) {
-    int filerow = ctx->view.rowoff + y;
-    dest->is_empty = (filerow >= ctx->model.numrows);
-    dest->row_num = dest->is_empty ? 0 : filerow + 1;
-    dest->segments = NULL;
-    dest->segment_count = 0;
-    dest->text = NULL;
+/* Take back everything handed out */
+static void frame_store_reset(FrameStore *fs) {
+    FrameBlock *b = fs->head;
+    if (!b) return;
+    if (!b->next) {
+        b->used = 0;
+        return;
+    }
+    size_t cap = 0;
+    while (b) {
+        FrameBlock *next = b->next;
+        cap += b->cap;
+        free(b);
+        b = next;
+    }
+    fs->head = frame_block_new(cap);  /* If NULL, frame_alloc() starts over */
+}
 
-    if (dest->is_empty) {
-        return 0;
+static void *frame_alloc(FrameStore *fs, size_t size) {
+    FrameBlock *b = fs->head;
+    size_t pad = b ? (size_t)(-(uintptr_t)(b->data + b->used)) & (FRAME_ALIGN - 1) : 0;
+    if (!b || b->cap - b->used < size + pad) {
+        size_t cap = b ? b->cap * 2 : FRAME_BLOCK_MIN;
+        while (cap < size + FRAME_ALIGN) cap *= 2;
+        FrameBlock *nb = frame_block_new(cap);
+        if (!nb) return NULL;
+        nb->next = b;
+        fs->head = b = nb;
+        pad = (size_t)(-(uintptr_t)b->data) & (FRAME_ALIGN - 1);
     }
+    void *p = b->data + b->used + pad;
+    b->used += pad + size;
+    return p;
+}
 
-    t_erow *row = &ctx->model.row[filerow];
+static char *frame_strndup(FrameStore *fs, const char *s, size_t len) {
+    char *p = frame_alloc(fs, len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
 
-    /* Build segments into temp array */
-    RenderSegment temp_segs[MAX_SEGMENTS_PER_ROW];
-    int seg_count = build_row_segments(ctx, row, filerow,
-                                       ctx->view.coloff, text_cols, temp_segs);
+/* Copy a string into the frame; NULL stays NULL. Sets *err on failure. */
+static char *frame_strdup(FrameStore *fs, const char *s, int *err) {
+    if (!s) return NULL;
+    char *p = frame_strndup(fs, s, strlen(s));
+    if (!p) *err = 1;
+    return p;
+}
 
-    if (seg_count == 0) {
+/* ======================= Helper Functions ================================== */
+
+/* Give 'dest' copies of 'count' segments, in the room it has if that is
+ * enough. */
+static int fill_row_view(CachedRow *dest, const RenderSegment *segs,
+                         int count) {
+    dest->view.segment_count = 0;
+    if (count == 0) {
         return 0;
     }
 
     /* Calculate total text length needed */
     size_t total_len = 0;
-    for (int i = 0; i < seg_count; i++) {
-        total_len += temp_segs[i].len;
+    for (int i = 0; i < count; i++) {
+        total_len += segs[i].len;
     }
 
-    /* Allocate backing text storage */
-    dest->text = malloc(total_len + 1);
-    if (!dest->text) return -1;
+    /* Grow backing text storage */
+    if (total_len + 1 > dest->text_cap) {
+        size_t cap = dest->text_cap ? dest->text_cap : 64;
+        while (cap < total_len + 1) cap *= 2;
+        char *text = realloc(dest->view.text, cap);
+        if (!text) return -1;
+        dest->view.text = text;
+        dest->text_cap = cap;
+    }
 
-    /* Allocate segments array */
-    dest->segments = malloc(seg_count * sizeof(RenderSegment));
-    if (!dest->segments) {
-        free(dest->text);
-        dest->text = NULL;
-        return -1;
+    /* Grow segments array */
+    if (count > dest->seg_cap) {
+        int cap = dest->seg_cap ? dest->seg_cap : 4;
+        while (cap < count) cap *= 2;
+        RenderSegment *segments = realloc(dest->view.segments,
+                                          cap * sizeof(RenderSegment));
+        if (!segments) return -1;
+        dest->view.segments = segments;
+        dest->seg_cap = cap;
     }
 
     /* Copy text and update segment pointers */
-    char *text_ptr = dest->text;
-    for (int i = 0; i < seg_count; i++) {
-        memcpy(text_ptr, temp_segs[i].text, temp_segs[i].len);
-        dest->segments[i].text = text_ptr;
-        dest->segments[i].len = temp_segs[i].len;
-        dest->segments[i].hl_type = temp_segs[i].hl_type;
-        dest->segments[i].selected = temp_segs[i].selected;
-        text_ptr += temp_segs[i].len;
+    char *text_ptr = dest->view.text;
+    for (int i = 0; i < count; i++) {
+        memcpy(text_ptr, segs[i].text, segs[i].len);
+        dest->view.segments[i].text = text_ptr;
+        dest->view.segments[i].len = segs[i].len;
+        dest->view.segments[i].hl_type = segs[i].hl_type;
+        dest->view.segments[i].selected = segs[i].selected;
+        text_ptr += segs[i].len;
     }
     *text_ptr = '\0';
-    dest->segment_count = seg_count;
+    dest->view.segment_count = count;
+
+    return 0;
+}
+
+/* Build the screen row showing 'line' (NULL: past the end) into 'dest' */
+static int copy_row_view(CachedRow *dest, EditorSession *session,
+                         const ScreenLine *line) {
+    editor_ctx_t *ctx = &session->ctx;
+    dest->view.is_empty = (line == NULL || line->row >= ctx->model.numrows);
+    int base = lazy_base(&ctx->model);
+    dest->view.row_num = dest->view.is_empty || line->start > 0 || base < 0 ?
+                         0 : base + line->row + 1;
+    dest->view.segment_count = 0;
+
+    if (dest->view.is_empty) {
+        return 0;
+    }
+
+    int col = line->start >= 0 ? line->start : ctx->view.coloff;
+    t_erow *row = editor_visible_row(ctx, line->row, col, line->len);
+
+    /* Build segments into the scratch array */
+    int seg_count = editor_row_segments(ctx, row, line->row, col, line->len,
+                                        &session->segs, &session->seg_cap);
+    return fill_row_view(dest, session->segs, seg_count);
+}
 
+/* Copy of a cached row view into the frame of a view model */
+static int put_row_view(FrameStore *fs, EditorRowView *dest,
+                        const EditorRowView *src) {
+    *dest = *src;
+    dest->segments = NULL;
+    dest->text = NULL;
+    if (src->segment_count == 0) return 0;
+
+    dest->segments = frame_alloc(fs, src->segment_count * sizeof(RenderSegment));
+    if (!dest->segments) return -1;
+    size_t len = 0;
+    for (int i = 0; i < src->segment_count; i++) len += src->segments[i].len;
+    dest->text = frame_strndup(fs, src->text, len);
+    if (!dest->text) return -1;
+
+    char *text_ptr = dest->text;
+    for (int i = 0; i < src->segment_count; i++) {
+        dest->segments[i] = src->segments[i];
+        dest->segments[i].text = text_ptr;
+        text_ptr += src->segments[i].len;
+    }
     return 0;
 }
 
-/* Free row view resources */
-static void free_row_view(EditorRowView *rv) {
-    free(rv->segments);
-    free(rv->text);
-    rv->segments = NULL;
-    rv->text = NULL;
-    rv->segment_count = 0;
+/* Free a cached row array and its rows */
+static void free_row_cache(CachedRow *cache, int count) {
+    if (!cache) return;
+    for (int i = 0; i < count; i++) {
+        free(cache[i].view.segments);
+        free(cache[i].view.text);
+    }
+    free(cache);
+}
+
+/* Make room for 'rows' entries in the cache and the spare */
+static int reserve_row_cache(EditorSession *session, int rows) {
+    if (rows <= session->rows_cap) return 0;
+    CachedRow *cache = realloc(session->cache, rows * sizeof(CachedRow));
+    if (!cache) return -1;
+    session->cache = cache;
+    CachedRow *spare = realloc(session->spare, rows * sizeof(CachedRow));
+    if (!spare) return -1;  /* The cache keeps its new size unused */
+    session->spare = spare;
+    size_t grown = (size_t)(rows - session->rows_cap) * sizeof(CachedRow);
+    memset(session->cache + session->rows_cap, 0, grown);
+    memset(session->spare + session->rows_cap, 0, grown);
+    session->rows_cap = rows;
+    return 0;
 }
 
 /* ======================= Session Lifecycle ================================= */
@@ -150,6 +273,7 @@ EditorSession *editor_session_new(const EditorConfig *config) {
 
     /* Initialize editor context */
     editor_ctx_init(&session->ctx);
+    editor_model_use_arena(&session->ctx.model);
 
     /* Apply configuration */
     if (config) {
@@ -229,6 +353,10 @@ void editor_session_free(EditorSession *session) {
         session->ctx.lua_host = NULL;
     }
 
+    free_row_cache(session->cache, session->rows_cap);
+    free_row_cache(session->spare, session->rows_cap);
+    free(session->segs);
+    editor_viewmodel_free(session->vm);
     editor_ctx_free(&session->ctx);
     free(session);
 }
@@ -264,28 +392,76 @@ int editor_session_handle_event(EditorSession *session, const EditorEvent *event
 
 /* ======================= View Model ======================================== */
 
-EditorViewModel *editor_session_snapshot(EditorSession *session) {
-    if (!session) return NULL;
+/* Fill vm->row_views. Rows unchanged since the previous snapshot are
+ * taken from the session's cache instead of being segmented again. */
+static int snapshot_rows(EditorSession *session, EditorViewModel *vm,
+                         int available_rows, int text_cols) {
+    editor_ctx_t *ctx = &session->ctx;
+    editor_view_fix(ctx);
+    ViewFrame frame;
+    view_frame_capture(ctx, &frame, session, available_rows, text_cols,
+                       vm->gutter_width);
+
+    if (reserve_row_cache(session, available_rows) < 0) return -1;
+
+    int shown;
+    const ScreenLine *lines = editor_screen_lines(ctx, available_rows, &shown,
+                                                  &frame.wrapped);
+    for (int y = 0; y < available_rows; y++) {
+        const ScreenLine *line = y < shown ? &lines[y] : NULL;
+        int k = -1;
+        if (line) {
+            k = view_frame_reusable_row(&ctx->model, &session->frame, &frame,
+                                        line->row);
+        }
 
+        /* The row built into the spare, or moved there from the cache; what
+         * the spare held there goes to the cache, which is the spare next
+         * time, so no row's buffers are lost or freed */
+        CachedRow *row = &session->spare[y];
+        int err = 0;
+        if (k >= 0 && k < session->cache_rows) {
+            CachedRow old = *row;
+            *row = session->cache[k];
+            session->cache[k] = old;
+        } else {
+            k = -1;
+            err = copy_row_view(row, session, line);
+            if (!row->view.is_empty) frame.rows_rebuilt++;
+        }
+        if (err == 0) err = put_row_view(vm->store, &vm->row_views[y], &row->view);
+        vm->row_views[y].prev_row = k;
+        if (err < 0) {
+            /* Cached rows may have moved without the frame saying so */
+            session->frame.valid = 0;
+            return -1;
+        }
+    }
+
+    CachedRow *cache = session->cache;
+    session->cache = session->spare;
+    session->spare = cache;
+    session->cache_rows = available_rows;
+    view_frame_commit(&ctx->model, &session->frame, &frame);
+    vm->rows_rebuilt = frame.rows_rebuilt;
+    return 0;
+}
+
+/* Fill 'vm' with the current render state, in its frame */
+static int snapshot_fill(EditorSession *session, EditorViewModel *vm) {
+    uint64_t span = trace_begin();
     editor_ctx_t *ctx = &session->ctx;
-    EditorViewModel *vm = calloc(1, sizeof(EditorViewModel));
-    if (!vm) return NULL;
+    FrameStore *fs = vm->store;
+    frame_store_reset(fs);
+    memset(vm, 0, sizeof(*vm));
+    vm->store = fs;
+    int err = 0;
 
     /* Screen dimensions */
     vm->rows = ctx->view.screenrows;
     vm->cols = ctx->view.screencols;
 
-    /* Calculate gutter width */
-    vm->gutter_width = 0;
-    if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-        int max_line = ctx->model.numrows;
-        vm->gutter_width = 1;
-        while (max_line >= 10) {
-            vm->gutter_width++;
-            max_line /= 10;
-        }
-        vm->gutter_width += 1; /* Space separator */
-    }
+    vm->gutter_width = editor_gutter_width(ctx);
 
     int text_cols = vm->cols - vm->gutter_width;
     if (text_cols < 1) text_cols = 1;
@@ -293,24 +469,27 @@ EditorViewModel *editor_session_snapshot(EditorSession *session) {
     /* Tab bar */
     int tabs_showing = (buffer_count() > 1) ? 1 : 0;
     if (tabs_showing) {
-        buffers_get_tab_info(&vm->tabs.labels, &vm->tabs.count, &vm->tabs.active);
+        int count = buffer_count();
+        vm->tabs.labels = frame_alloc(fs, count * sizeof(char *));
+        if (!vm->tabs.labels) goto fail;
+        for (int i = 0; i < count; i++) {
+            char label[16];
+            int id = buffer_get_id_at(i);
+            snprintf(label, sizeof(label), "[%d]", id);
+            vm->tabs.labels[i] = frame_strdup(fs, label, &err);
+            if (id == buffer_get_current_id()) vm->tabs.active = i;
+        }
+        vm->tabs.count = count;
     }
 
     /* Row views */
     int available_rows = ctx->view.screenrows - tabs_showing;
+    if (available_rows < 0) available_rows = 0;
     vm->row_count = available_rows;
-    vm->row_views = calloc(available_rows, sizeof(EditorRowView));
-    if (!vm->row_views) {
-        editor_viewmodel_free(vm);
-        return NULL;
-    }
+    vm->row_views = frame_alloc(fs, available_rows * sizeof(EditorRowView));
+    if (!vm->row_views) goto fail;
 
-    for (int y = 0; y < available_rows; y++) {
-        if (copy_row_view(&vm->row_views[y], ctx, y, vm->gutter_width, text_cols) < 0) {
-            editor_viewmodel_free(vm);
-            return NULL;
-        }
-    }
+    if (snapshot_rows(session, vm, available_rows, text_cols) < 0) goto fail;
 
     /* Status bar */
     const char *mode_str = "";
@@ -322,53 +501,42 @@ EditorViewModel *editor_session_snapshot(EditorSession *session) {
         case MODE_COMMAND: mode_str = "COMMAND"; break;
     }
 
-    /* Get language indicator */
-    const LokiLangOps *lang = loki_lang_for_file(ctx->model.filename);
-    char lang_buf[16] = "";
-    if (lang && lang->is_initialized && lang->is_initialized(ctx)) {
-        snprintf(lang_buf, sizeof(lang_buf), "%s ", lang->name);
-        for (int i = 0; lang_buf[i] && i < 15; i++) {
-            if (lang_buf[i] >= 'a' && lang_buf[i] <= 'z') {
-                lang_buf[i] -= 32;
-            }
-        }
-    }
-
-    /* Copy status info with owned strings */
-    vm->status_mode = safe_strdup(mode_str);
-    vm->status_filename = safe_strdup(ctx->model.filename);
-    vm->status_lang = safe_strdup(lang_buf);
+    /* Copy status info into the frame */
+    vm->status_mode = frame_strdup(fs, mode_str, &err);
+    vm->status_filename = frame_strdup(fs, ctx->model.filename, &err);
+    vm->status_lang = frame_strdup(fs, editor_lang_label(ctx), &err);
 
     vm->status.mode = vm->status_mode;
     vm->status.filename = vm->status_filename;
     vm->status.lang = vm->status_lang;
-    vm->status.numrows = ctx->model.numrows;
-    vm->status.current_row = ctx->view.rowoff + ctx->view.cy + 1;
+    editor_status_lines(ctx, &vm->status.current_row, &vm->status.numrows);
     vm->status.dirty = ctx->model.dirty;
     vm->status.playing = loki_lang_is_playing(ctx);
     vm->status.link_active = link_active;
 
     /* Message line */
     if (ctx->view.statusmsg[0] && time(NULL) - ctx->view.statusmsg_time < 5) {
-        vm->message = safe_strdup(ctx->view.statusmsg);
+        vm->message = frame_strdup(fs, ctx->view.statusmsg, &err);
     }
 
     /* REPL pane */
     t_lua_repl *repl = ctx_repl(ctx);
     if (repl && repl->active) {
         vm->repl_active = 1;
-        vm->repl_prompt = safe_strdup(LUA_REPL_PROMPT);
-        vm->repl_input = repl->input_len > 0 ? strndup(repl->input, repl->input_len) : NULL;
+        vm->repl_prompt = frame_strdup(fs, LUA_REPL_PROMPT, &err);
+        if (repl->input_len > 0) {
+            vm->repl_input = frame_strndup(fs, repl->input, repl->input_len);
+            if (!vm->repl_input) goto fail;
+        }
 
         /* Copy log lines */
-        vm->repl_log_count = repl->log_len;
         if (repl->log_len > 0) {
-            vm->repl_log = calloc(repl->log_len, sizeof(char *));
-            if (vm->repl_log) {
-                for (int i = 0; i < repl->log_len; i++) {
-                    vm->repl_log[i] = safe_strdup(repl->log[i]);
-                }
+            vm->repl_log = frame_alloc(fs, repl->log_len * sizeof(char *));
+            if (!vm->repl_log) goto fail;
+            for (int i = 0; i < repl->log_len; i++) {
+                vm->repl_log[i] = frame_strdup(fs, repl->log[i], &err);
             }
+            vm->repl_log_count = repl->log_len;
         }
 
         vm->repl.prompt = vm->repl_prompt;
@@ -378,6 +546,7 @@ EditorViewModel *editor_session_snapshot(EditorSession *session) {
         vm->repl.log_count = vm->repl_log_count;
         vm->repl.max_display_lines = LUA_REPL_OUTPUT_ROWS;
     }
+    if (err) goto fail;
 
     /* Cursor position */
     if (repl && repl->active) {
@@ -392,21 +561,11 @@ EditorViewModel *editor_session_snapshot(EditorSession *session) {
         if (vm->cursor.col > ctx->view.screencols) vm->cursor.col = ctx->view.screencols;
         vm->cursor.visible = 1;
     } else {
-        int cx = 1;
+        int cx = editor_cursor_screen_col(ctx) + 1;
         int filerow = ctx->view.rowoff + ctx->view.cy;
-        t_erow *row = (filerow >= ctx->model.numrows) ? NULL : &ctx->model.row[filerow];
-        if (row) {
-            for (int j = ctx->view.coloff; j < (ctx->view.cx + ctx->view.coloff); j++) {
-                if (j < row->size && row->chars[j] == TAB)
-                    cx += 7 - ((cx) % 8);
-                cx++;
-            }
-        }
-        if (ctx->view.line_numbers && ctx->model.numrows > 0) {
-            cx += vm->gutter_width;
-        }
+        cx += vm->gutter_width;
         int tab_offset = tabs_showing ? 1 : 0;
-        vm->cursor.row = ctx->view.cy + 1 + tab_offset;
+        vm->cursor.row = editor_cursor_screen_row(ctx) + 1 + tab_offset;
         vm->cursor.col = cx;
         if (vm->cursor.col > ctx->view.screencols) vm->cursor.col = ctx->view.screencols;
         vm->cursor.file_row = filerow;
@@ -414,41 +573,53 @@ EditorViewModel *editor_session_snapshot(EditorSession *session) {
         vm->cursor.visible = 1;
     }
 
-    return vm;
-}
+    trace_end("segments", span);
+    return 0;
 
-void editor_viewmodel_free(EditorViewModel *vm) {
-    if (!vm) return;
+fail:
+    /* Nothing half-filled is left to read */
+    memset(vm, 0, sizeof(*vm));
+    vm->store = fs;
+    return -1;
+}
 
-    /* Free row views */
-    if (vm->row_views) {
-        for (int i = 0; i < vm->row_count; i++) {
-            free_row_view(&vm->row_views[i]);
-        }
-        free(vm->row_views);
+static EditorViewModel *viewmodel_new(void) {
+    EditorViewModel *vm = calloc(1, sizeof(EditorViewModel));
+    if (!vm) return NULL;
+    vm->store = calloc(1, sizeof(FrameStore));
+    if (!vm->store) {
+        free(vm);
+        return NULL;
     }
+    return vm;
+}
 
-    /* Free tab info */
-    buffers_free_tab_info(vm->tabs.labels, vm->tabs.count);
+EditorViewModel *editor_session_snapshot(EditorSession *session) {
+    if (!session) return NULL;
 
-    /* Free status strings */
-    free(vm->status_mode);
-    free(vm->status_filename);
-    free(vm->status_lang);
+    EditorViewModel *vm = viewmodel_new();
+    if (!vm) return NULL;
+    if (snapshot_fill(session, vm) < 0) {
+        editor_viewmodel_free(vm);
+        return NULL;
+    }
+    return vm;
+}
 
-    /* Free message */
-    free(vm->message);
+int editor_session_snapshot_into(EditorSession *session, EditorViewModel *vm) {
+    if (!session || !vm || !vm->store) return -1;
+    return snapshot_fill(session, vm);
+}
 
-    /* Free REPL data */
-    free(vm->repl_prompt);
-    free(vm->repl_input);
-    if (vm->repl_log) {
-        for (int i = 0; i < vm->repl_log_count; i++) {
-            free(vm->repl_log[i]);
-        }
-        free(vm->repl_log);
-    }
+const EditorViewModel *editor_session_frame(EditorSession *session) {
+    if (!session) return NULL;
+    if (!session->vm && !(session->vm = viewmodel_new())) return NULL;
+    return snapshot_fill(session, session->vm) == 0 ? session->vm : NULL;
+}
 
+void editor_viewmodel_free(EditorViewModel *vm) {
+    if (!vm) return;
+    frame_store_free(vm->store);
     free(vm);
 }
 
@@ -12,9 +12,8 @@
  *   editor_session_handle_event(session, &ev);
  *
  *   // Get render state
- *   EditorViewModel *vm = editor_session_snapshot(session);
- *   // ... render using vm ...
- *   editor_viewmodel_free(vm);
+ *   const EditorViewModel *vm = editor_session_frame(session);
+ *   // ... render using vm, until the next frame ...
  *
  *   editor_session_free(session);
  */
@@ -68,15 +67,19 @@ typedef struct {
 /**
  * EditorRowView - Render data for a single row.
  *
- * Contains owned copies of all data needed to render one row.
- * The segments array contains text spans with styling information.
+ * Contains copies of all data needed to render one row, owned by its view
+ * model. The segments array contains text spans with styling information.
  */
 typedef struct {
-    int row_num;            /* Row number (1-based, 0 for empty rows past EOF) */
+    int row_num;            /* Row number (1-based, 0 for empty rows past EOF
+                             * and where a wrapped row goes on) */
     int is_empty;           /* True if this is an empty row (past end of file) */
     RenderSegment *segments;/* Array of render segments (owned) */
     int segment_count;      /* Number of segments */
     char *text;             /* Backing storage for segment text (owned) */
+    int prev_row;           /* Screen row it was drawn at in the session's
+                               previous snapshot, unchanged since; -1 if
+                               rebuilt */
 } EditorRowView;
 
 /**
@@ -103,7 +106,9 @@ typedef struct {
  * EditorViewModel - Complete render state snapshot.
  *
  * Contains all data needed to render the editor UI.
- * All data is owned by the view model and must be freed with editor_viewmodel_free().
+ * All data is owned by the view model, in its frame store, and is freed
+ * with it by editor_viewmodel_free(). Filling the model again
+ * (editor_session_snapshot_into()) reuses that memory.
  *
  * This is a deep copy of the editor state at a point in time, safe to use
  * from any thread and survives subsequent editor mutations.
@@ -117,6 +122,8 @@ typedef struct {
     EditorRowView *row_views;   /* Array of row views (owned) */
     int row_count;              /* Number of row views */
     int gutter_width;           /* Width of line number gutter (0 if disabled) */
+    int rows_rebuilt;           /* Rows segmented for this snapshot; the
+                                   others were unchanged since the last one */
 
     /* Tab bar */
     EditorTabInfo tabs;         /* Tab information (owned) */
@@ -140,6 +147,8 @@ typedef struct {
 
     /* Cursor */
     EditorCursor cursor;        /* Cursor position */
+
+    struct FrameStore *store;   /* Memory of all of the above (owned) */
 } EditorViewModel;
 
 /* ======================= Session Lifecycle ================================= */
@@ -183,6 +192,33 @@ int editor_session_handle_event(EditorSession *session, const EditorEvent *event
  */
 EditorViewModel *editor_session_snapshot(EditorSession *session);
 
+/**
+ * Fill a view model again with the current render state.
+ *
+ * The model's memory from its last fill is reused, so once it has grown to
+ * the size of a frame, refilling it allocates nothing. Row views unchanged
+ * since the session's last snapshot are copied rather than rebuilt. Hosts
+ * that keep the previous frame (to send deltas of it) fill two models in
+ * turn.
+ *
+ * @param session  Editor session
+ * @param vm       View model from editor_session_snapshot(), overwritten
+ * @return 0 on success, -1 on error (vm is then empty but still valid)
+ */
+int editor_session_snapshot_into(EditorSession *session, EditorViewModel *vm);
+
+/**
+ * Get the current render state in the session's own frame.
+ *
+ * As editor_session_snapshot_into() on a view model the session keeps:
+ * no allocations once it has grown to the size of a frame. The result is
+ * valid until the next call, or until the session is freed.
+ *
+ * @param session  Editor session
+ * @return The session's frame, or NULL on error
+ */
+const EditorViewModel *editor_session_frame(EditorSession *session);
+
 /**
  * Free a view model and all owned data.
  *
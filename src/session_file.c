@@ -0,0 +1,361 @@
+/* session_file.c - Sessions: the open buffers, saved and restored
+ *
+ * See session_file.h for an overview. Files are written to a temporary
+ * name and renamed over the old one, so a snapshot a buffer still has
+ * mapped is never truncated under it.
+ */
+
+#define _DEFAULT_SOURCE     /* realpath(), strdup() */
+
+#include "session_file.h"
+#include "buffers.h"
+#include "diff.h"
+#include "fold.h"
+#include "lazy.h"
+#include "undo.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char *auto_path = NULL;
+
+static char *session_strdup(const char *s) {
+    char *p = strdup(s);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+void session_buffer_free(SessionBuffer *b) {
+    if (!b) return;
+    free(b->path);
+    free(b->snapshot);
+    free(b->folds);
+    free(b);
+}
+
+/* A hash of the rows, to tell whether an undo state gave them back */
+static uint64_t text_hash(const EditorModel *model) {
+    uint64_t h = (uint64_t)model->numrows;
+    for (int i = 0; i < model->numrows; i++) {
+        const t_erow *row = &model->row[i];
+        h = (h ^ diff_hash(row->chars, (size_t)row->size)) * UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+/* Write 'len' bytes to 'path' through a temporary file */
+static int write_replace(const char *path, const char *data, size_t len) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    int ok = fwrite(data, 1, len, f) == len;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Snapshot the rows of a modified buffer to 'path', likewise */
+static int snapshot_replace(const EditorModel *model, const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (editor_model_save_snapshot(model, tmp) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void copy_buffer(SessionBuffer *to, const SessionBuffer *from) {
+    *to = *from;
+    to->path = from->path ? session_strdup(from->path) : NULL;
+    to->snapshot = from->snapshot ? session_strdup(from->snapshot) : NULL;
+    to->folds = NULL;
+    if (from->nfolds > 0) {
+        to->folds = malloc((size_t)from->nfolds * sizeof(SessionFold));
+        if (to->folds == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        memcpy(to->folds, from->folds, (size_t)from->nfolds * sizeof(SessionFold));
+    }
+}
+
+/* Fill in 'b' from buffer 'id', snapshotting its rows to "path.n" if it
+ * has changes a file does not hold. Returns 0, or -1 if they could not
+ * be written. */
+static int collect(SessionBuffer *b, int id, const char *path, int n) {
+    const EditorView *view;
+    editor_ctx_t *ctx = buffer_peek(id, &view);
+    EditorModel *model = &ctx->model;
+
+    memset(b, 0, sizeof(*b));
+    if (model->filename) {
+        char real[PATH_MAX];
+        b->path = session_strdup(realpath(model->filename, real) ? real : model->filename);
+    }
+    b->row = view->rowoff + view->cy;
+    b->col = view->coloff + view->cx;
+    b->rowoff = view->rowoff;
+    b->coloff = view->coloff;
+    if (view->line_numbers) b->flags |= SESSION_LINE_NUMBERS;
+    if (view->word_wrap) b->flags |= SESSION_WORD_WRAP;
+
+    if (model->lazy) {
+        /* Read-only but for hex edits, which go with the file */
+        int base = lazy_base(model);
+        if (base >= 0) {
+            b->row += base;
+            b->rowoff += base;
+            b->flags |= SESSION_LAZY;
+        }
+        return 0;
+    }
+
+    b->undo_seq = undo_state_seq(ctx, NULL);
+    if (model->dirty || !model->filename) {
+        /* Its rows, wherever they went meanwhile */
+        if (buffer_get_state(id) != BUFFER_LOADED) {
+            ctx = buffer_get(id);
+            model = &ctx->model;
+        }
+        char snap[PATH_MAX];
+        if (snprintf(snap, sizeof(snap), "%s.%d", path, n) >= (int)sizeof(snap)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (snapshot_replace(model, snap) != 0) return -1;
+        b->snapshot = session_strdup(snap);
+        b->text_hash = text_hash(model);
+        b->flags |= SESSION_MODIFIED;
+    }
+
+    int count = fold_count(model->folds);
+    if (count > 0) {
+        b->folds = malloc((size_t)count * sizeof(SessionFold));
+        if (b->folds == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (int i = 0; i < count; i++) {
+            SessionFold *f = &b->folds[b->nfolds];
+            if (fold_get(model->folds, i, &f->first, &f->last, &f->closed) == 0)
+                b->nfolds++;
+        }
+    }
+    return 0;
+}
+
+int session_file_save(const char *path) {
+    int count = buffer_count();
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int *ids = malloc((size_t)count * sizeof(int));
+    SessionState st = { calloc((size_t)count, sizeof(SessionBuffer)), 0, 0 };
+    if (!ids || !st.buf) {
+        perror("Out of memory");
+        exit(1);
+    }
+    count = buffer_get_list(ids, count);
+
+    int current = buffer_get_current_id(), result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        SessionBuffer *b = &st.buf[st.count];
+        if (ids[i] == current) st.current = st.count;
+
+        /* Not shown since a session restored it: as restored, unless it
+         * has a snapshot, which has to move to this session's name */
+        const SessionBuffer *pending = buffer_get_restore(ids[i]);
+        if (pending && !pending->snapshot) {
+            copy_buffer(b, pending);
+            st.count++;
+            continue;
+        }
+        if (pending) {
+            const EditorView *view;
+            editor_ctx_t *ctx = buffer_get(ids[i]);
+            if (buffer_peek(ids[i], &view) && view == &ctx->view) {
+                session_file_apply(ctx, pending);
+                buffer_set_restore(ids[i], NULL);
+            }
+        }
+        result = collect(b, ids[i], path, st.count);
+        st.count++;
+    }
+
+    char *data = NULL;
+    size_t len = 0;
+    if (result == 0) result = session_serialize(&st, &data, &len);
+    if (result == 0) result = write_replace(path, data, len);
+    free(data);
+    free(ids);
+
+    /* Snapshots of buffers since closed or saved */
+    char snap[PATH_MAX];
+    for (int i = 0; result == 0; i++) {
+        if (snprintf(snap, sizeof(snap), "%s.%d", path, i) >= (int)sizeof(snap)) break;
+        if (i < st.count && st.buf[i].snapshot) continue;
+        if (unlink(snap) != 0 && i >= st.count) break;
+    }
+    count = st.count;
+    session_state_free(&st);
+    return result == 0 ? count : -1;
+}
+
+int session_file_is_session(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    char head[6];
+    int ok = fread(head, 1, sizeof(head), f) == sizeof(head) &&
+             memcmp(head, "LOKI", 4) == 0 &&
+             (unsigned char)head[4] == LOKI_SESSION_VERSION && head[5] == 0;
+    fclose(f);
+    return ok;
+}
+
+/* Whether the current buffer is an empty unnamed one, left to go */
+static int current_is_scratch(void) {
+    editor_ctx_t *ctx = buffer_get_current();
+    if (!ctx || ctx->model.filename || ctx->model.dirty) return 0;
+    return ctx->model.numrows == 0 ||
+           (ctx->model.numrows == 1 && ctx->model.row[0].size == 0);
+}
+
+int session_file_load(const char *path, int *missing) {
+    if (missing) *missing = 0;
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    char *data = NULL;
+    size_t len = 0, cap = 0, n;
+    do {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            char *p = realloc(data, cap);
+            if (p == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+            data = p;
+        }
+        n = fread(data + len, 1, cap - len, f);
+        len += n;
+    } while (n > 0);
+    fclose(f);
+
+    SessionState st;
+    int result = session_deserialize(&st, data, len);
+    free(data);
+    if (result != 0) return -1;
+
+    int scratch = current_is_scratch() ? buffer_get_current_id() : -1;
+    int opened = 0, show = -1;
+    for (int i = 0; i < st.count; i++) {
+        SessionBuffer *b = &st.buf[i];
+        int id = b->path ? buffer_create(b->path) : -1;
+        /* A file gone, or never named: its snapshot, if it has one */
+        if (id < 0 && (b->snapshot || !b->path)) id = buffer_create(NULL);
+        if (id < 0) {
+            if (missing) (*missing)++;
+            continue;
+        }
+        SessionBuffer *restore = malloc(sizeof(SessionBuffer));
+        if (restore == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        *restore = *b;
+        memset(b, 0, sizeof(*b));
+        buffer_set_restore(id, restore);
+        if (show < 0 || i == st.current) show = id;
+        opened++;
+    }
+    session_state_free(&st);
+
+    /* The one shown is read now, the rest in the background */
+    if (show >= 0) {
+        buffer_switch(show);
+        if (scratch >= 0) buffer_close(scratch, 0);
+        buffers_prefetch();
+    }
+    return opened;
+}
+
+/* Whether the buffer's text is the one saved, after going to the undo
+ * state it was at (through the file's undo journal) */
+static int same_text(editor_ctx_t *ctx, const SessionBuffer *b) {
+    if (!b->path || ctx->model.filename == NULL) return 0;
+    if (b->undo_seq > 0 && undo_state_seq(ctx, NULL) != b->undo_seq &&
+        undo_goto(ctx, b->undo_seq) < 0)
+        return 0;
+    return text_hash(&ctx->model) == b->text_hash;
+}
+
+void session_file_apply(editor_ctx_t *ctx, const SessionBuffer *b) {
+    EditorModel *model = &ctx->model;
+
+    if ((b->flags & SESSION_MODIFIED) && !same_text(ctx, b)) {
+        if (!b->snapshot || editor_model_map_snapshot(model, b->snapshot) != 0) {
+            editor_set_status_msg(ctx, "Lost unsaved changes: can't read %s",
+                                  b->snapshot ? b->snapshot : "their snapshot");
+        } else {
+            /* Rows in place in the snapshot, their history not in the
+             * file's journal */
+            if (model->dirty == 0 && model->filename) model->dirty = 1;
+            editor_model_damage_shift(model, 0);
+            undo_history_detach(ctx);
+        }
+    }
+
+    ctx->view.line_numbers = (b->flags & SESSION_LINE_NUMBERS) != 0;
+    ctx->view.word_wrap = (b->flags & SESSION_WORD_WRAP) != 0;
+    if (model->lazy) {
+        if (b->flags & SESSION_LAZY) lazy_goto(ctx, b->row);
+        return;
+    }
+
+    for (int i = 0; i < b->nfolds; i++)
+        editor_fold_add(model, b->folds[i].first, b->folds[i].last, b->folds[i].closed);
+
+    int row = b->row, col = b->col;
+    if (row >= model->numrows) row = model->numrows - 1;
+    if (row < 0) row = 0;
+    int size = row < model->numrows ? model->row[row].size : 0;
+    if (col > size) col = size;
+    if (col < 0) col = 0;
+    editor_cursor_to(ctx, row, col);
+    /* Scrolled as it was, if the cursor is on the screen that way */
+    if (b->rowoff >= 0 && b->rowoff <= row && row - b->rowoff < ctx->view.screenrows) {
+        ctx->view.rowoff = b->rowoff;
+        ctx->view.cy = row - b->rowoff;
+    }
+    if (b->coloff >= 0 && b->coloff <= col && col - b->coloff < ctx->view.screencols) {
+        ctx->view.coloff = b->coloff;
+        ctx->view.cx = col - b->coloff;
+    }
+}
+
+void session_file_set_auto(const char *path) {
+    free(auto_path);
+    auto_path = path ? session_strdup(path) : NULL;
+}
+
+void session_file_autosave(void) {
+    if (auto_path && buffer_count() > 0) session_file_save(auto_path);
+}
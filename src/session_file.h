@@ -0,0 +1,58 @@
+/* session_file.h - Sessions: the open buffers, saved and restored
+ *
+ * :mksession [file] writes the buffers open, in order, to a session file
+ * (SESSION_FILE_DEFAULT if not named): each one's file, cursor, scroll
+ * position and folds, and the undo state its text is at. The format is a
+ * version of serialize.c's (see serialize.h), and holds no text: a
+ * buffer's file does, but for unnamed buffers and those with unsaved
+ * changes, whose rows go to a snapshot beside the session, <file>.<n>,
+ * that is mapped as it is when read back.
+ *
+ * :session [file] (or loki --session FILE) restores a session without
+ * reading every file first: each buffer is created unread, the one that
+ * was shown is read and shown at once, and buffers_prefetch() reads the
+ * others on worker threads meanwhile. A buffer's view and folds are put
+ * back when it is first shown (buffer_set_restore()); files too large to
+ * load open lazily as always, at the line they were at. A buffer with
+ * unsaved changes goes back to its undo state through the file's undo
+ * journal when that gives the same text again, keeping its history, and
+ * else maps its snapshot.
+ *
+ * With --session, the session is written back to its file at exit.
+ */
+
+#ifndef LOKI_SESSION_FILE_H
+#define LOKI_SESSION_FILE_H
+
+#include "internal.h"
+#include "serialize.h"
+
+/* Session file :mksession writes when not given one */
+#define SESSION_FILE_DEFAULT "Session.loki"
+
+/* Write the open buffers to a session file at 'path'. Returns the
+ * buffers written, or -1 (errno set) if it could not be written. */
+int session_file_save(const char *path);
+
+/* Open the buffers of the session file at 'path', after those open, and
+ * show the one it showed. The current buffer goes if it is an empty
+ * unnamed one. Returns the buffers opened, or -1 if the file is not a
+ * session; *missing, if not NULL, gets the files that are gone. */
+int session_file_load(const char *path, int *missing);
+
+/* Whether the file at 'path' starts as a session file does */
+int session_file_is_session(const char *path);
+
+/* Put a buffer back as 'b' has it: its text (for a modified buffer),
+ * folds and view. buffers.c calls it when the buffer is first shown. */
+void session_file_apply(editor_ctx_t *ctx, const SessionBuffer *b);
+
+/* Free a SessionBuffer from session_file_load(). Safe on NULL. */
+void session_buffer_free(SessionBuffer *b);
+
+/* Write the session to 'path' at exit (session_file_autosave()), or
+ * not if NULL */
+void session_file_set_auto(const char *path);
+void session_file_autosave(void);
+
+#endif /* LOKI_SESSION_FILE_H */
@@ -0,0 +1,232 @@
+/* sort.c - Sorting lines (:sort)
+ *
+ * See sort.h for an overview.
+ */
+
+#include "sort.h"
+#include "columns.h"
+#include "task_pool.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sorted as they are below this, by insertion */
+#define SORT_INSERTION_MAX 16
+
+/* The number of a row without one: below any other */
+#define SORT_NO_NUMBER LLONG_MIN
+
+typedef struct SortKey {
+    const char *chars;
+    long long num;          /* SORT_NUMERIC only */
+    int len;
+    int index;              /* Row, from the first of the range */
+} SortKey;
+
+typedef struct SortJob SortJob;
+typedef void (*SortStep)(SortJob *job, int i);
+
+struct SortJob {
+    const t_erow *rows;     /* The first row of the range */
+    int flags;
+    ColumnIndex *columns;   /* Sorting by field 'column' of the rows, */
+    int first, column;      /* indexed, the range from row 'first' */
+    SortKey *keys;          /* The runs so far */
+    SortKey *tmp;           /* Room for the next round's */
+    int runs[SORT_MAX_WORKERS + 1]; /* Starts of the runs, then the end */
+    int nruns;
+    SortStep step;          /* Run for steps 0..nsteps-1 */
+    int nsteps;
+    atomic_int next;
+};
+
+/* The first decimal number in the 'len' bytes at 's', or SORT_NO_NUMBER */
+static long long row_number(const char *s, int len) {
+    int i = 0;
+    while (i < len && !isdigit((unsigned char)s[i])) i++;
+    if (i == len) return SORT_NO_NUMBER;
+    int negative = i > 0 && s[i - 1] == '-';
+    long long n = 0;
+    for (; i < len && isdigit((unsigned char)s[i]); i++)
+        n = n > (LLONG_MAX - 9) / 10 ? LLONG_MAX : n * 10 + (s[i] - '0');
+    return negative ? -n : n;
+}
+
+/* <0, 0 or >0 as 'a' sorts before, with or after 'b', the rows' order
+ * left out */
+static int compare_keys(const SortKey *a, const SortKey *b, int flags) {
+    int c;
+    if (flags & SORT_NUMERIC) {
+        c = (a->num > b->num) - (a->num < b->num);
+    } else {
+        c = memcmp(a->chars, b->chars, (size_t)(a->len < b->len ? a->len : b->len));
+        if (c == 0) c = (a->len > b->len) - (a->len < b->len);
+    }
+    return flags & SORT_REVERSE ? -c : c;
+}
+
+/* Merge the sorted runs at 'a' and 'b' into 'out', 'a' first on ties */
+static void merge_runs(const SortKey *a, int na, const SortKey *b, int nb,
+                       SortKey *out, int flags) {
+    int i = 0, j = 0;
+    while (i < na && j < nb) {
+        if (compare_keys(&b[j], &a[i], flags) < 0) *out++ = b[j++];
+        else *out++ = a[i++];
+    }
+    memcpy(out, a + i, sizeof(SortKey) * (size_t)(na - i));
+    memcpy(out + na - i, b + j, sizeof(SortKey) * (size_t)(nb - j));
+}
+
+/* Stable merge sort of the 'n' keys at 'keys', with room for as many at
+ * 'tmp' */
+static void merge_sort(SortKey *keys, SortKey *tmp, int n, int flags) {
+    if (n <= SORT_INSERTION_MAX) {
+        for (int i = 1; i < n; i++) {
+            SortKey k = keys[i];
+            int j = i;
+            while (j > 0 && compare_keys(&k, &keys[j - 1], flags) < 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = k;
+        }
+        return;
+    }
+    int half = n / 2;
+    merge_sort(keys, tmp, half, flags);
+    merge_sort(keys + half, tmp + half, n - half, flags);
+    /* Halves already in order (rows mostly sorted, as logs are) stay */
+    if (compare_keys(&keys[half], &keys[half - 1], flags) >= 0) return;
+    merge_runs(keys, half, keys + half, n - half, tmp, flags);
+    memcpy(keys, tmp, sizeof(SortKey) * (size_t)n);
+}
+
+/* Step: key and sort run 'i' */
+static void sort_run(SortJob *job, int i) {
+    int from = job->runs[i], to = job->runs[i + 1];
+    for (int r = from; r < to; r++) {
+        SortKey *k = &job->keys[r];
+        k->chars = job->rows[r].chars;
+        k->len = job->rows[r].size;
+        k->index = r;
+        if (job->column >= 0) {
+            /* Already indexed: only read */
+            int start = columns_field(job->columns, job->first + r, k->chars,
+                                      k->len, job->column, &k->len);
+            if (start < 0) start = k->len = 0;
+            k->chars += start;
+        }
+        k->num = job->flags & SORT_NUMERIC ? row_number(k->chars, k->len) : 0;
+    }
+    merge_sort(job->keys + from, job->tmp + from, to - from, job->flags);
+}
+
+/* Step: merge runs 2i and 2i+1 (or take run 2i, the last, as it is) */
+static void merge_pair(SortJob *job, int i) {
+    int a = job->runs[2 * i], b = job->runs[2 * i + 1];
+    int end = 2 * i + 2 <= job->nruns ? job->runs[2 * i + 2] : b;
+    merge_runs(job->keys + a, b - a, job->keys + b, end - b, job->tmp + a,
+               job->flags);
+}
+
+static void sort_worker(void *arg) {
+    SortJob *job = arg;
+    int i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->nsteps) job->step(job, i);
+}
+
+/* Run steps 0..nsteps-1 of 'step', spread over the pool */
+static void run_steps(SortJob *job, SortStep step, int nsteps) {
+    job->step = step;
+    job->nsteps = nsteps;
+    atomic_store(&job->next, 0);
+
+    /* The calling thread works too, so submit one fewer helper. */
+    Task *tasks[SORT_MAX_WORKERS];
+    int started = 0;
+    while (started < nsteps - 1 &&
+           (tasks[started] = task_submit(sort_worker, job, TASK_PRIORITY_HIGH, NULL))) {
+        started++;
+    }
+    sort_worker(job);
+    for (int i = 0; i < started; i++) task_wait(tasks[i]);
+}
+
+int sort_parse_flags(const char *args, int *column) {
+    int flags = 0;
+    *column = -1;
+    for (const char *p = args ? args : ""; *p; p++) {
+        if (isdigit((unsigned char)*p)) {
+            char *end;
+            long n = strtol(p, &end, 10);
+            if (n < 1 || n > COLUMNS_MAX || *column >= 0) return -1;
+            *column = (int)n - 1;
+            p = end - 1;
+        } else if (*p == 'n') flags |= SORT_NUMERIC;
+        else if (*p == 'r') flags |= SORT_REVERSE;
+        else if (*p == 'u') flags |= SORT_UNIQUE;
+        else if (!isspace((unsigned char)*p)) return -1;
+    }
+    return flags;
+}
+
+int sort_lines(editor_ctx_t *ctx, int first, int last, int flags, int column) {
+    if (editor_refuse_edit(ctx)) return -1;
+    int n = last - first + 1;
+    SortJob job;
+    job.rows = ctx->model.row + first;
+    job.flags = flags;
+    job.columns = ctx->model.columns;
+    job.first = first;
+    job.column = job.columns ? column : -1;
+    if (job.column >= 0) columns_index_rows(job.columns, ctx->model.row, first, last);
+    job.keys = malloc(sizeof(SortKey) * (size_t)n);
+    job.tmp = malloc(sizeof(SortKey) * (size_t)n);
+    if (job.keys == NULL || job.tmp == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    /* A run per thread, each sorted alone */
+    int nruns = 1;
+    if (n >= SORT_PARALLEL_MIN) {
+        nruns = task_pool_threads();
+        if (nruns > SORT_MAX_WORKERS) nruns = SORT_MAX_WORKERS;
+        if (nruns < 1) nruns = 1;
+    }
+    for (int i = 0; i <= nruns; i++) job.runs[i] = (int)((long long)n * i / nruns);
+    job.nruns = nruns;
+    run_steps(&job, sort_run, nruns);
+
+    /* Then merged pairwise, a round at a time */
+    while (job.nruns > 1) {
+        int pairs = (job.nruns + 1) / 2;
+        run_steps(&job, merge_pair, pairs);
+        SortKey *t = job.keys;
+        job.keys = job.tmp;
+        job.tmp = t;
+        for (int i = 0; i < pairs; i++) job.runs[i] = job.runs[2 * i];
+        job.runs[pairs] = n;
+        job.nruns = pairs;
+    }
+
+    /* The rows in their new order, the repeats left out */
+    int *order = (int *)job.tmp;
+    int count = 0, moved = 0;
+    for (int i = 0; i < n; i++) {
+        if ((flags & SORT_UNIQUE) && count > 0 &&
+            compare_keys(&job.keys[i], &job.keys[order[count - 1]], flags) == 0)
+            continue;
+        if (job.keys[i].index != i) moved = 1;
+        order[count++] = i;
+    }
+    for (int i = 0; i < count; i++) order[i] = job.keys[order[i]].index;
+    if (moved || count < n) editor_permute_rows(ctx, first, last, order, count);
+
+    free(job.keys);
+    free(job.tmp);
+    return count;
+}
@@ -0,0 +1,46 @@
+/* sort.h - Sorting lines (:sort)
+ *
+ * sort_lines() sorts rows first..last as vi's :sort does: by their bytes,
+ * or (SORT_NUMERIC) by the first decimal number in each, a '-' before it
+ * making it negative and rows without one going first. What is sorted is
+ * an array of keys, one per row, holding its index, its text and its
+ * number, parsed once beforehand so no comparison parses anything. The
+ * rows then move to their places in one pass (editor_permute_rows()), as
+ * one undo step, their text never copied.
+ *
+ * Ranges of SORT_PARALLEL_MIN rows or more are sorted on the task pool: a
+ * slice of the rows per thread, keyed and merge sorted alone, then the
+ * sorted slices merged pairwise, the merges of each round side by side.
+ * Ties keep the rows' order, so the result is the same however the range
+ * is split.
+ *
+ * In column mode (columns.h) a row can be sorted by one of its fields
+ * instead: the range is indexed first (on the pool as well), and each
+ * key is the field as the index has it.
+ */
+
+#ifndef LOKI_SORT_H
+#define LOKI_SORT_H
+
+#include "internal.h"
+
+#define SORT_NUMERIC 1      /* n: by the first number in the row */
+#define SORT_REVERSE 2      /* r: largest first */
+#define SORT_UNIQUE  4      /* u: of rows sorting equal, only the first */
+
+/* Rows sorted on one thread below this, and threads used at most */
+#define SORT_PARALLEL_MIN 65536
+#define SORT_MAX_WORKERS 64
+
+/* The flags of "n", "ru", "n u 3" and the like, or -1 for anything else.
+ * A number is the column to sort by, from 1, which goes to *column from
+ * 0 (-1 for none). */
+int sort_parse_flags(const char *args, int *column);
+
+/* Sort rows first..last (within the buffer) by 'flags', and by field
+ * 'column' of each (from 0; -1 for the whole row) in column mode. Rows
+ * without that field sort as empty. Returns the rows they are now, fewer
+ * with SORT_UNIQUE, or -1 if the buffer can't be edited. */
+int sort_lines(editor_ctx_t *ctx, int first, int last, int flags, int column);
+
+#endif /* LOKI_SORT_H */
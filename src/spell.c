@@ -0,0 +1,352 @@
+/* spell.c - Spell checking of the rows shown
+ *
+ * See spell.h for an overview. A slot of the dictionary holds the offset
+ * of a word in the mapped list, plus one (0: empty); words equal but for
+ * case share a hash and sit in the same probe run.
+ */
+
+#define _DEFAULT_SOURCE     /* strdup() */
+
+#include "spell.h"
+#include "decor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct SpellDict {
+    const char *map;
+    size_t size;
+    uint32_t *slots;
+    uint32_t mask;              /* Slots - 1 */
+    uint64_t *bloom;
+    uint64_t bloom_mask;        /* Bits - 1 */
+    int words;
+} SpellDict;
+
+static SpellDict *dict;
+static int dict_errno;          /* Why the list could not be read (0: it
+                                 * was not tried), so it is not again */
+static char *dict_path;
+static SpellStats stats;
+
+/* ========================= Dictionary ========================= */
+
+static int lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static int is_upper(int c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+/* No lower case letter in it */
+static int word_upper_only(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] >= 'a' && s[i] <= 'z') return 0;
+    return 1;
+}
+
+/* FNV-1a of the word in lower case */
+static uint64_t word_hash(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)lower((unsigned char)s[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* The Bloom filter bits of a hash, by double hashing */
+static uint64_t bloom_bit(uint64_t h, int i) {
+    return h + (uint64_t)i * ((h >> 32) | 1);
+}
+
+/* The word at 'off' of the list, up to its line's end */
+static size_t entry_len(const SpellDict *d, uint32_t off) {
+    const char *s = d->map + off;
+    const char *nl = memchr(s, '\n', d->size - off);
+    size_t len = nl ? (size_t)(nl - s) : d->size - off;
+    if (len > 0 && s[len - 1] == '\r') len--;
+    return len;
+}
+
+static void dict_free(SpellDict *d) {
+    if (d == NULL) return;
+    if (d->map) munmap((void *)d->map, d->size);
+    free(d->slots);
+    free(d->bloom);
+    free(d);
+}
+
+static void dict_add(SpellDict *d, uint32_t off, size_t len) {
+    uint64_t h = word_hash(d->map + off, len);
+    for (int i = 0; i < SPELL_BLOOM_K; i++) {
+        uint64_t bit = bloom_bit(h, i) & d->bloom_mask;
+        d->bloom[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    uint32_t slot = (uint32_t)h & d->mask;
+    while (d->slots[slot]) slot = (slot + 1) & d->mask;
+    d->slots[slot] = off + 1;
+    d->words++;
+}
+
+/* Map the list at 'path' and hash its words. NULL, with errno, if it
+ * cannot be read. */
+static SpellDict *dict_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    int bad = fstat(fd, &st) == -1 ? errno : 0;
+    if (bad == 0 && (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+                     (uint64_t)st.st_size >= UINT32_MAX))
+        bad = EINVAL;
+    if (bad) {
+        close(fd);
+        errno = bad;
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved;
+        return NULL;
+    }
+
+    SpellDict *d = calloc(1, sizeof(SpellDict));
+    if (d == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    d->map = map;
+    d->size = (size_t)st.st_size;
+
+    /* Sized for its lines: slots at most half full */
+    size_t lines = 1;
+    for (const char *p = d->map; (p = memchr(p, '\n', d->size - (size_t)(p - d->map)));
+         p++)
+        lines++;
+    size_t cap = 16, bits = 64;
+    while (cap < lines * 2) cap <<= 1;
+    while (bits < lines * SPELL_BLOOM_BITS) bits <<= 1;
+    d->mask = (uint32_t)(cap - 1);
+    d->bloom_mask = bits - 1;
+    d->slots = calloc(cap, sizeof(uint32_t));
+    d->bloom = calloc(bits / 64, sizeof(uint64_t));
+    if (d->slots == NULL || d->bloom == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+
+    /* The hashing walks the list once, from start to end */
+    posix_madvise(map, d->size, POSIX_MADV_SEQUENTIAL);
+    uint32_t off = 0;
+    while (off < d->size) {
+        size_t len = entry_len(d, off);
+        if (len > 0) dict_add(d, off, len);
+        const char *nl = memchr(d->map + off, '\n', d->size - off);
+        if (nl == NULL) break;
+        off = (uint32_t)(nl - d->map) + 1;
+    }
+    posix_madvise(map, d->size, POSIX_MADV_RANDOM);
+    return d;
+}
+
+static SpellDict *dict_get(void) {
+    if (dict == NULL && dict_errno == 0) {
+        dict = dict_load(spell_get_file());
+        if (dict == NULL) dict_errno = errno ? errno : EINVAL;
+    }
+    return dict;
+}
+
+/* Whether 'word' may be written as the list's 'entry', equal but for
+ * case: as it is, in capitals, or capitalised or in lower case if the
+ * entry is in lower case */
+static int case_ok(const char *entry, const char *word, size_t len) {
+    if (memcmp(entry, word, len) == 0) return 1;
+    int word_lower = 1, word_upper = 1, later_upper = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (is_upper((unsigned char)entry[i])) return word_upper_only(word, len);
+        if (is_upper((unsigned char)word[i])) {
+            word_lower = 0;
+            if (i > 0) later_upper = 1;
+        } else if (word[i] >= 'a' && word[i] <= 'z') {
+            word_upper = 0;
+        }
+    }
+    return word_lower || word_upper || !later_upper;
+}
+
+static int dict_has(const SpellDict *d, const char *word, size_t len) {
+    uint64_t h = word_hash(word, len);
+    for (int i = 0; i < SPELL_BLOOM_K; i++) {
+        uint64_t bit = bloom_bit(h, i) & d->bloom_mask;
+        if (!(d->bloom[bit >> 6] & (1ULL << (bit & 63)))) {
+            stats.rejected++;
+            return 0;
+        }
+    }
+    for (uint32_t slot = (uint32_t)h & d->mask; d->slots[slot];
+         slot = (slot + 1) & d->mask) {
+        uint32_t off = d->slots[slot] - 1;
+        const char *entry = d->map + off;
+        if (entry_len(d, off) != len) continue;
+        size_t i = 0;
+        while (i < len && lower((unsigned char)entry[i]) == lower((unsigned char)word[i])) i++;
+        if (i == len && case_ok(entry, word, len)) return 1;
+    }
+    return 0;
+}
+
+void spell_set_file(const char *path) {
+    free(dict_path);
+    dict_path = NULL;
+    if (path) {
+        dict_path = strdup(path);
+        if (dict_path == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    dict_free(dict);
+    dict = NULL;
+    dict_errno = 0;
+}
+
+const char *spell_get_file(void) {
+    return dict_path ? dict_path : SPELL_DEFAULT_FILE;
+}
+
+int spell_word_ok(const char *word, size_t len) {
+    SpellDict *d = dict_get();
+    if (d == NULL) return 0;
+    stats.words++;
+    if (dict_has(d, word, len)) return 1;
+    /* A possessive of a word in the list */
+    if (len > 2 && word[len - 2] == '\'' && lower((unsigned char)word[len - 1]) == 's' &&
+        dict_has(d, word, len - 2))
+        return 1;
+    stats.misspelt++;
+    return 0;
+}
+
+/* ========================= Rows ========================= */
+
+static int is_letter(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/* Whether highlight 'hl' is prose for the buffer's syntax */
+static int prose_hl(const editor_ctx_t *ctx, int hl) {
+    if (ctx->view.syntax == NULL) return 1;
+    if (ctx->view.syntax->type == HL_TYPE_MARKDOWN)
+        /* Text, headers, bold and italic; not code or links */
+        return hl == HL_NORMAL || hl == HL_KEYWORD1 || hl == HL_KEYWORD2 ||
+               hl == HL_COMMENT;
+    return hl == HL_COMMENT || hl == HL_MLCOMMENT || hl == HL_STRING;
+}
+
+/* Whether the word in chars [start, end) is a name rather than prose:
+ * joined to digits or '_', in mixed case (camelCase), or part of a path,
+ * an address or a file name */
+static int is_name(const char *s, int size, int start, int end) {
+    unsigned char before = start > 0 ? (unsigned char)s[start - 1] : ' ';
+    unsigned char after = end < size ? (unsigned char)s[end] : ' ';
+    if (before == '_' || after == '_' || (before >= '0' && before <= '9') ||
+        (after >= '0' && after <= '9'))
+        return 1;
+    if (before == '/' || before == '\\' || before == '@' || before == '$' ||
+        before == '.' || before == '#' || before == '%')
+        return 1;
+    if ((after == '.' || after == '/' || after == '@' || after == ':') &&
+        end + 1 < size && is_letter((unsigned char)s[end + 1]))
+        return 1;
+    int upper_later = 0, lower_any = 0;
+    for (int i = start; i < end; i++) {
+        if (is_upper((unsigned char)s[i]) && i > start) upper_later = 1;
+        if (s[i] >= 'a' && s[i] <= 'z') lower_any = 1;
+    }
+    return upper_later && lower_any;
+}
+
+static void check_row(editor_ctx_t *ctx, int at) {
+    t_erow *row = &ctx->model.row[at];
+    /* Long rows are highlighted a window at a time: not checked */
+    if (row->size >= ROW_LONG_MIN) return;
+    if (ctx->view.syntax && ctx->view.syntax->type == HL_TYPE_MARKDOWN &&
+        row->cb_entry != CB_LANG_NONE)
+        return;     /* In a code block */
+    stats.rows++;
+
+    const char *s = row->chars;
+    int tabs = memchr(s, '\t', (size_t)row->size) != NULL;
+    int i = 0;
+    while (i < row->size) {
+        if (!is_letter((unsigned char)s[i])) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < row->size && (is_letter((unsigned char)s[i]) ||
+               (s[i] == '\'' && i + 1 < row->size && is_letter((unsigned char)s[i + 1]) &&
+                i > start)))
+            i++;
+        int end = i;
+        if (end - start < 2 || is_name(s, row->size, start, end)) continue;
+
+        int rx_start = tabs ? editor_row_cx_to_rx(row, start) : start;
+        int rx_last = tabs ? editor_row_cx_to_rx(row, end - 1) : end - 1;
+        if (!prose_hl(ctx, editor_row_hl_at(row, rx_start)) ||
+            !prose_hl(ctx, editor_row_hl_at(row, rx_last)))
+            continue;
+        if (!spell_word_ok(s + start, (size_t)(end - start)))
+            editor_decorate(&ctx->model, DECOR_GROUP_SPELL, at, start,
+                            end - start, SPELL_HL);
+    }
+}
+
+void spell_check_rows(editor_ctx_t *ctx, int first, int last) {
+    if (!ctx->model.spell || dict_get() == NULL) return;
+    if (first < 0) first = 0;
+    if (last > ctx->model.numrows) last = ctx->model.numrows;
+    if (first >= last) return;
+    editor_undecorate_rows(&ctx->model, DECOR_GROUP_SPELL, first, last - 1);
+    for (int r = first; r < last; r++) check_row(ctx, r);
+}
+
+/* ========================= Buffers ========================= */
+
+int spell_enable(editor_ctx_t *ctx) {
+    if (dict_get() == NULL) {
+        editor_set_status_msg(ctx, "Spell file %s: %s", spell_get_file(),
+                              strerror(dict_errno));
+        return -1;
+    }
+    /* Each row is checked as the hook next sees it */
+    ctx->model.spell = 1;
+    for (int r = 0; r < ctx->model.numrows; r++) ctx->model.row[r].hl_hooked = 0;
+    editor_undecorate(&ctx->model, DECOR_GROUP_SPELL);
+    return 0;
+}
+
+void spell_disable(editor_ctx_t *ctx) {
+    ctx->model.spell = 0;
+    editor_undecorate(&ctx->model, DECOR_GROUP_SPELL);
+}
+
+void spell_stats(SpellStats *out) {
+    *out = stats;
+    out->dict_words = dict ? dict->words : 0;
+}
+
+void spell_cleanup(void) {
+    spell_set_file(NULL);
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,71 @@
+/* spell.h - Spell checking of the rows shown
+ *
+ * With :set spell, the words of a buffer's prose are looked up in a word
+ * list, one word a line (/usr/share/dict/words, or :set spellfile=PATH),
+ * and those not in it are decorated in DECOR_GROUP_SPELL. Prose is the
+ * comments and strings of code, the text of Markdown outside code, and
+ * all of a buffer with no syntax.
+ *
+ * Rows are checked from the syntax row hook (see syntax_set_row_hook()),
+ * which sees a row once it is highlighted and read, that is shown or
+ * edited, and not again until it is highlighted anew. Scrolling back over
+ * rows checked before costs nothing, and the rest of the buffer is never
+ * looked at.
+ *
+ * The word list is mapped when spell checking is first turned on, not
+ * copied: the dictionary is a table of 32-bit offsets into the mapping,
+ * hashed on the lower case word, and a Bloom filter of the same hashes
+ * rejecting most misspelt words before the table is probed.
+ */
+
+#ifndef LOKI_SPELL_H
+#define LOKI_SPELL_H
+
+#include <stddef.h>
+#include "internal.h"
+
+/* Word list used unless :set spellfile says otherwise */
+#define SPELL_DEFAULT_FILE "/usr/share/dict/words"
+
+/* Decoration style of misspelt words */
+#define SPELL_HL HL_KEYWORD1
+
+/* Bloom filter bits per word of the list, and bits set per word */
+#define SPELL_BLOOM_BITS 10
+#define SPELL_BLOOM_K 3
+
+typedef struct SpellStats {
+    unsigned long rows;         /* Rows checked */
+    unsigned long words;        /* Words looked up */
+    unsigned long rejected;     /* ... turned away by the Bloom filter */
+    unsigned long misspelt;     /* ... not in the word list */
+    int dict_words;             /* Words in the list (0: not loaded) */
+} SpellStats;
+
+/* Check the buffer's words from now on: its rows are checked again as
+ * they are next shown. Returns 0, or -1 (with a status message) if the
+ * word list cannot be read. */
+int spell_enable(editor_ctx_t *ctx);
+
+/* Stop, and remove its decorations */
+void spell_disable(editor_ctx_t *ctx);
+
+/* Use the word list at 'path' (NULL: SPELL_DEFAULT_FILE), mapped when
+ * next needed */
+void spell_set_file(const char *path);
+const char *spell_get_file(void);
+
+/* Check rows [first, last) of the buffer, replacing their decorations.
+ * Called by the syntax row hook for buffers with spell checking on. */
+void spell_check_rows(editor_ctx_t *ctx, int first, int last);
+
+/* Whether the 'len' bytes at 'word' are in the word list, loading it if
+ * need be (0 if it cannot be) */
+int spell_word_ok(const char *word, size_t len);
+
+void spell_stats(SpellStats *out);
+
+/* Unmap the word list */
+void spell_cleanup(void);
+
+#endif /* LOKI_SPELL_H */
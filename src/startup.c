@@ -0,0 +1,88 @@
+/* startup.c - Startup phase timings
+ *
+ * See startup.h for an overview.
+ */
+
+#include "startup.h"
+#include <uv.h>
+
+static StartupPhase phases[STARTUP_MAX_PHASES];
+static int nphases = 0;
+static StartupDeferred deferred[STARTUP_MAX_DEFERRED];
+static int ndeferred = 0;
+static uint64_t begun = 0;          /* 0: not begun */
+static uint64_t last_mark = 0;
+static int ended = 0;
+
+static double ms(uint64_t ns) {
+    return (double)ns / 1e6;
+}
+
+void startup_begin(void) {
+    begun = last_mark = uv_hrtime();
+    nphases = 0;
+    ndeferred = 0;
+    ended = 0;
+}
+
+void startup_mark(const char *name) {
+    if (!startup_active()) return;
+    uint64_t now = uv_hrtime();
+    if (nphases < STARTUP_MAX_PHASES) {
+        phases[nphases].name = name;
+        phases[nphases].ns = now - last_mark;
+        nphases++;
+    }
+    last_mark = now;
+}
+
+void startup_end(void) {
+    ended = 1;
+}
+
+int startup_active(void) {
+    return begun != 0 && !ended;
+}
+
+void startup_note_deferred(const char *name, uint64_t start) {
+    if (begun == 0 || ndeferred >= STARTUP_MAX_DEFERRED) return;
+    uint64_t now = uv_hrtime();
+    deferred[ndeferred].name = name;
+    deferred[ndeferred].at_ns = start > begun ? start - begun : 0;
+    deferred[ndeferred].ns = now - start;
+    ndeferred++;
+}
+
+int startup_phase_count(void) {
+    return nphases;
+}
+
+const StartupPhase *startup_phase(int i) {
+    return i >= 0 && i < nphases ? &phases[i] : NULL;
+}
+
+int startup_deferred_count(void) {
+    return ndeferred;
+}
+
+const StartupDeferred *startup_deferred(int i) {
+    return i >= 0 && i < ndeferred ? &deferred[i] : NULL;
+}
+
+uint64_t startup_total_ns(void) {
+    return begun ? last_mark - begun : 0;
+}
+
+void startup_print(FILE *fp) {
+    for (int i = 0; i < nphases; i++)
+        fprintf(fp, "  %-16s %8.2f ms\n", phases[i].name, ms(phases[i].ns));
+
+    uint64_t total = startup_total_ns();
+    int shown = 0;
+    for (int i = 0; i < ndeferred; i++) {
+        if (deferred[i].at_ns > total) continue;
+        if (!shown++) fprintf(fp, "on first use (within the phases above):\n");
+        fprintf(fp, "  %-16s %8.2f ms at %.2f ms\n", deferred[i].name,
+                ms(deferred[i].ns), ms(deferred[i].at_ns));
+    }
+}
@@ -0,0 +1,62 @@
+/* startup.h - Startup phase timings (--startup-time)
+ *
+ * loki_editor_main() marks the end of each phase of startup as it goes,
+ * and so does the Lua bootstrap within its own: the phases are timed from
+ * one mark to the next. Subsystems that are brought up on first use rather
+ * than at startup (tree-sitter highlight queries, libcurl, language
+ * states) note when that happened and what it took, so the report shows
+ * what moved out of the way of the first frame, and where it landed.
+ *
+ * Marks after startup_end() are ignored, so code shared with later Lua
+ * states and buffers can mark unconditionally. Main thread only.
+ */
+
+#ifndef LOKI_STARTUP_H
+#define LOKI_STARTUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STARTUP_MAX_PHASES 32
+#define STARTUP_MAX_DEFERRED 16
+
+typedef struct StartupPhase {
+    const char *name;       /* Static: kept, not copied */
+    uint64_t ns;            /* Since the previous mark */
+} StartupPhase;
+
+typedef struct StartupDeferred {
+    const char *name;       /* Static, like a phase's */
+    uint64_t at_ns;         /* Since startup_begin(), when it ran */
+    uint64_t ns;            /* What it took */
+} StartupDeferred;
+
+/* Start timing the phases, from now */
+void startup_begin(void);
+
+/* The phase since the previous mark (or startup_begin()) ends now */
+void startup_mark(const char *name);
+
+/* Stop recording phases: startup is over */
+void startup_end(void);
+
+/* Is startup being timed (begun and not ended)? */
+int startup_active(void);
+
+/* A subsystem was brought up on first use, from 'start' (uv_hrtime())
+ * until now. Recorded while there is room, after startup too. */
+void startup_note_deferred(const char *name, uint64_t start);
+
+/* The phases recorded, and the deferred initializations */
+int startup_phase_count(void);
+const StartupPhase *startup_phase(int i);
+int startup_deferred_count(void);
+const StartupDeferred *startup_deferred(int i);
+
+/* Time from startup_begin() to the last mark */
+uint64_t startup_total_ns(void);
+
+/* Print the phases, then what was deferred and ran before the last mark */
+void startup_print(FILE *fp);
+
+#endif /* LOKI_STARTUP_H */
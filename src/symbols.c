@@ -0,0 +1,1202 @@
+/* symbols.c - Project symbol index
+ *
+ * See symbols.h for an overview. One job runs at a time, on the task
+ * pool: it indexes the marked files (SYM_JOB_FILES), or writes the index
+ * again (SYM_JOB_WRITE), walking the tree first for symbols_refresh().
+ * The main thread changes the mapped index and the files kept in memory
+ * (the overlay) only when it takes a job in, so while a job runs both
+ * stay as they are and the job reads them without a copy.
+ */
+
+#define _DEFAULT_SOURCE     /* d_type, realpath(), strdup() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <uv.h>
+#include <stdatomic.h>
+
+#include "symbols.h"
+#include "grep.h"
+#include "loader.h"
+#include "task_pool.h"
+#include "treesitter.h"
+#include "undo_journal.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define SYMBOLS_MAGIC "LOKISYM1"
+#define SYMBOLS_VERSION 1
+
+/* The index file: a SymHeader, then 'nfiles' SymFileRec sorted by path,
+ * 'nsyms' SymRec sorted by name (then file and line), and the strings
+ * both point into */
+typedef struct SymHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nfiles;
+    uint32_t nsyms;
+    uint32_t reserved;
+    uint64_t strings_size;
+} SymHeader;
+
+typedef struct SymFileRec {
+    uint32_t path;          /* Offset in the strings */
+    uint32_t path_len;
+    int64_t mtime_ns;
+    int64_t size;
+    uint64_t hash;          /* undo_journal_hash() of the contents */
+} SymFileRec;
+
+typedef struct SymRec {
+    uint32_t name;          /* Offset in the strings */
+    uint16_t name_len;
+    uint8_t kind;           /* TS_TAG_* */
+    uint8_t reserved;
+    uint32_t file;
+    uint32_t line;          /* 1-based */
+} SymRec;
+
+/* The index as mapped. Offsets are checked as records are read. */
+typedef struct SymMap {
+    LoadedFile file;
+    const SymFileRec *files;
+    const SymRec *syms;
+    const char *strings;
+    uint32_t nfiles, nsyms;
+    uint64_t strings_size;
+} SymMap;
+
+/* A symbol of a file indexed in memory */
+typedef struct SymItem {
+    const char *name;       /* Into the file's 'names', or the mapped index */
+    uint32_t off;           /* Of the name in 'names', until sealed */
+    uint16_t len;
+    uint8_t kind;
+    int line;               /* 1-based */
+} SymItem;
+
+/* A file indexed in memory */
+typedef struct SymFile {
+    char *path;             /* Relative to the root */
+    int64_t mtime_ns, size;
+    uint64_t hash;
+    int gone;               /* Deleted, or no longer to be indexed */
+    SymItem *items;
+    int count, cap;
+    char *names;
+    size_t names_len, names_cap;
+} SymFile;
+
+enum { SYM_JOB_FILES, SYM_JOB_WRITE };
+
+typedef struct SymJob {
+    int id;
+    int kind;               /* SYM_JOB_* */
+    int walk;               /* SYM_JOB_WRITE: walk the tree first */
+    char **paths;           /* SYM_JOB_FILES: the files to index */
+    int npaths;
+    SymFile *out;           /* SYM_JOB_FILES: their entries, by 'paths' */
+    int written;            /* SYM_JOB_WRITE: the index was written */
+    long files, symbols;    /* SYM_JOB_WRITE: what it holds */
+    int pooled;             /* Runs on the pool, and reports with an event */
+    Task *task;
+    atomic_int cancel;
+    atomic_int joining;     /* finish_job() waits: no event needed */
+} SymJob;
+
+static struct {
+    char *root;             /* As given; NULL when closed */
+    char *real;             /* realpath() of the root */
+    SymMap map;
+    int mapped;
+    unsigned char *shadowed;    /* By mapped file: the overlay has it */
+    SymFile *overlay;       /* Sorted by path */
+    int noverlay, overlay_cap;
+    char **marked;          /* Files to index, relative to the root */
+    int nmarked, marked_cap;
+    uint64_t marked_at;     /* uv_hrtime() of the last mark */
+    int walk_wanted;
+    int write_failed;       /* Don't try again until the next change */
+    SymJob *job;
+    int next_id;
+    uv_fs_event_t *watch;   /* Freed once closed; NULL if none */
+} sym;
+
+/* ======================== Reading the index ======================== */
+
+/* Compare a[0..alen) with b[0..blen), bytes then length. */
+static int name_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int map_open(SymMap *map, const char *path) {
+    memset(map, 0, sizeof(*map));
+    if (loader_open(path, &map->file) != 0) return -1;
+    const SymHeader *h = (const SymHeader *)map->file.data;
+    if (map->file.size < sizeof(*h) ||
+        memcmp(h->magic, SYMBOLS_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != SYMBOLS_VERSION) {
+        loader_close(&map->file);
+        return -1;
+    }
+    uint64_t size = sizeof(*h) + (uint64_t)h->nfiles * sizeof(SymFileRec) +
+                    (uint64_t)h->nsyms * sizeof(SymRec) + h->strings_size;
+    if (size != map->file.size) {
+        loader_close(&map->file);
+        return -1;
+    }
+    map->nfiles = h->nfiles;
+    map->nsyms = h->nsyms;
+    map->strings_size = h->strings_size;
+    map->files = (const SymFileRec *)(h + 1);
+    map->syms = (const SymRec *)(map->files + map->nfiles);
+    map->strings = (const char *)(map->syms + map->nsyms);
+    return 0;
+}
+
+/* A record's string, or NULL if it points out of the strings. */
+static const char *map_string(const SymMap *map, uint32_t off, uint32_t len) {
+    if ((uint64_t)off + len > map->strings_size) return NULL;
+    return map->strings + off;
+}
+
+/* Index of the mapped file at 'path', or -1. */
+static int map_find_file(const SymMap *map, const char *path, size_t len) {
+    uint32_t lo = 0, hi = map->nfiles;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const SymFileRec *f = &map->files[mid];
+        const char *p = map_string(map, f->path, f->path_len);
+        int c = p ? name_cmp(p, f->path_len, path, len) : -1;
+        if (c == 0) return (int)mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+/* Index of the first mapped symbol whose name is 'query' or after it. */
+static uint32_t map_lower_bound(const SymMap *map, const char *query,
+                                size_t len) {
+    uint32_t lo = 0, hi = map->nsyms;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const SymRec *s = &map->syms[mid];
+        const char *name = map_string(map, s->name, s->name_len);
+        if (name && name_cmp(name, s->name_len, query, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* ======================== Files in memory ======================== */
+
+static void sym_file_free(SymFile *f) {
+    free(f->path);
+    free(f->items);
+    free(f->names);
+    memset(f, 0, sizeof(*f));
+}
+
+/* treesitter_tags() callback: add a symbol, its name trimmed. Clauses of
+ * one definition (Haskell's equations) come in a row: only the first is
+ * kept. */
+static void sym_file_add(void *opaque, const char *name, uint32_t len,
+                         int kind, int row) {
+    SymFile *f = opaque;
+    while (len && (*name == ' ' || *name == '\t')) { name++; len--; }
+    while (len && (name[len - 1] == ' ' || name[len - 1] == '\t' ||
+                   name[len - 1] == '\r' || name[len - 1] == '\n')) len--;
+    if (len == 0 || len > SYMBOLS_MAX_NAME || memchr(name, '\n', len)) return;
+    if (f->count > 0) {
+        const SymItem *last = &f->items[f->count - 1];
+        if (last->kind == kind && last->len == len &&
+            memcmp(f->names + last->off, name, len) == 0) return;
+    }
+
+    if (f->count == f->cap) {
+        int cap = f->cap ? f->cap * 2 : 16;
+        SymItem *items = realloc(f->items, sizeof(*items) * (size_t)cap);
+        if (!items) {
+            perror("Out of memory");
+            exit(1);
+        }
+        f->items = items;
+        f->cap = cap;
+    }
+    if (f->names_len + len > f->names_cap) {
+        size_t cap = f->names_cap ? f->names_cap * 2 : 256;
+        while (cap < f->names_len + len) cap *= 2;
+        char *names = realloc(f->names, cap);
+        if (!names) {
+            perror("Out of memory");
+            exit(1);
+        }
+        f->names = names;
+        f->names_cap = cap;
+    }
+    SymItem *it = &f->items[f->count++];
+    it->name = NULL;
+    it->off = (uint32_t)f->names_len;
+    it->len = (uint16_t)len;
+    it->kind = (uint8_t)kind;
+    it->line = row + 1;
+    memcpy(f->names + f->names_len, name, len);
+    f->names_len += len;
+}
+
+/* Point the symbols' names at the file's names, now they stopped moving. */
+static void sym_file_seal(SymFile *f) {
+    for (int i = 0; i < f->count; i++) f->items[i].name = f->names + f->items[i].off;
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/* The language whose tags the file at 'path' has, or NULL */
+static const char *sym_lang(const char *path) {
+#ifdef LOKI_USE_LINENOISE
+    return treesitter_lang_from_filename(path);
+#else
+    (void)path;
+    return NULL;
+#endif
+}
+
+/* Read and parse the file 'f->path' (under the root), noting its size,
+ * mtime and hash. If the hash is 'same_hash' (and 'reuse' is given), the
+ * file is not parsed and *reuse is set instead. A file that can't be
+ * read, or has no tags, is marked gone. */
+static void sym_file_index(SymFile *f, const char *root, uint64_t same_hash,
+                           int *reuse) {
+    char full[PATH_MAX];
+    struct stat st;
+    const char *lang = sym_lang(f->path);
+    if (reuse) *reuse = 0;
+    f->gone = 1;
+    if (lang == NULL ||
+        snprintf(full, sizeof(full), "%s/%s", root, f->path) >= (int)sizeof(full) ||
+        stat(full, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (size_t)st.st_size > SYMBOLS_MAX_FILE)
+        return;
+
+    LoadedFile file;
+    if (loader_open(full, &file) != 0) return;
+    f->gone = loader_is_binary(&file);
+    f->mtime_ns = stat_mtime_ns(&st);
+    f->size = (int64_t)file.size;
+    f->hash = undo_journal_hash(UNDO_JOURNAL_HASH_INIT, file.data, file.size);
+    if (!f->gone) {
+        if (reuse && f->hash == same_hash) {
+            *reuse = 1;
+#ifdef LOKI_USE_LINENOISE
+        } else {
+            treesitter_tags(lang, file.data ? file.data : "", file.size,
+                            sym_file_add, f);
+#endif
+        }
+    }
+    loader_close(&file);
+    sym_file_seal(f);
+}
+
+/* Index of the overlay's file at 'path', or -(insertion point) - 1. */
+static int overlay_find(const char *path) {
+    int lo = 0, hi = sym.noverlay;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(sym.overlay[mid].path, path);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -lo - 1;
+}
+
+static void overlay_clear(void) {
+    for (int i = 0; i < sym.noverlay; i++) sym_file_free(&sym.overlay[i]);
+    sym.noverlay = 0;
+    if (sym.shadowed) memset(sym.shadowed, 0, sym.map.nfiles);
+}
+
+/* Keep 'f' in the overlay (taking it), over an older entry. */
+static void overlay_put(SymFile *f) {
+    int at = overlay_find(f->path);
+    if (at >= 0) {
+        sym_file_free(&sym.overlay[at]);
+        sym.overlay[at] = *f;
+        return;
+    }
+    at = -at - 1;
+    if (sym.noverlay == sym.overlay_cap) {
+        int cap = sym.overlay_cap ? sym.overlay_cap * 2 : 64;
+        SymFile *o = realloc(sym.overlay, sizeof(*o) * (size_t)cap);
+        if (!o) {
+            perror("Out of memory");
+            exit(1);
+        }
+        sym.overlay = o;
+        sym.overlay_cap = cap;
+    }
+    memmove(&sym.overlay[at + 1], &sym.overlay[at],
+            sizeof(*sym.overlay) * (size_t)(sym.noverlay - at));
+    sym.overlay[at] = *f;
+    sym.noverlay++;
+    if (sym.mapped) {
+        int m = map_find_file(&sym.map, f->path, strlen(f->path));
+        if (m >= 0) sym.shadowed[m] = 1;
+    }
+}
+
+/* ======================== Writing the index ======================== */
+
+/* A file as written: its symbols are either a SymFile's or mapped */
+typedef struct SymOut {
+    const char *path;
+    size_t path_len;
+    int64_t mtime_ns, size;
+    uint64_t hash;
+    const SymItem *items;
+    int count;
+} SymOut;
+
+/* A symbol being sorted for writing */
+typedef struct SymSort {
+    const char *name;
+    uint16_t len;
+    uint8_t kind;
+    uint32_t file;
+    uint32_t line;
+} SymSort;
+
+static int out_cmp(const void *a, const void *b) {
+    const SymOut *x = a, *y = b;
+    return name_cmp(x->path, x->path_len, y->path, y->path_len);
+}
+
+static int sort_cmp(const void *a, const void *b) {
+    const SymSort *x = a, *y = b;
+    int c = name_cmp(x->name, x->len, y->name, y->len);
+    if (c != 0) return c;
+    if (x->file != y->file) return x->file < y->file ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* Write the files (sorted here) as the index at 'root'/.loki/index.
+ * Returns 0, or -1 on error. */
+static int write_index(const char *root, SymOut *files, size_t nfiles,
+                       long *nsyms_out) {
+    qsort(files, nfiles, sizeof(*files), out_cmp);
+    size_t nsyms = 0;
+    for (size_t i = 0; i < nfiles; i++) nsyms += (size_t)files[i].count;
+    if (nfiles > UINT32_MAX || nsyms > UINT32_MAX) return -1;
+
+    SymSort *sorted = malloc(sizeof(*sorted) * (nsyms ? nsyms : 1));
+    SymFileRec *frecs = malloc(sizeof(*frecs) * (nfiles ? nfiles : 1));
+    SymRec *srecs = malloc(sizeof(*srecs) * (nsyms ? nsyms : 1));
+    if (!sorted || !frecs || !srecs) {
+        perror("Out of memory");
+        exit(1);
+    }
+    size_t n = 0;
+    uint64_t strings = 0;
+    for (size_t i = 0; i < nfiles; i++) {
+        frecs[i].path = (uint32_t)strings;
+        frecs[i].path_len = (uint32_t)files[i].path_len;
+        frecs[i].mtime_ns = files[i].mtime_ns;
+        frecs[i].size = files[i].size;
+        frecs[i].hash = files[i].hash;
+        strings += files[i].path_len;
+        for (int k = 0; k < files[i].count; k++) {
+            const SymItem *it = &files[i].items[k];
+            SymSort *s = &sorted[n++];
+            s->name = it->name;
+            s->len = it->len;
+            s->kind = it->kind;
+            s->file = (uint32_t)i;
+            s->line = (uint32_t)it->line;
+        }
+    }
+    qsort(sorted, nsyms, sizeof(*sorted), sort_cmp);
+    /* Equal names are next to each other now: they share their string */
+    for (size_t i = 0; i < nsyms; i++) {
+        if (i == 0 || name_cmp(sorted[i].name, sorted[i].len,
+                               sorted[i - 1].name, sorted[i - 1].len) != 0) {
+            srecs[i].name = (uint32_t)strings;
+            strings += sorted[i].len;
+        } else {
+            srecs[i].name = srecs[i - 1].name;
+        }
+        srecs[i].name_len = sorted[i].len;
+        srecs[i].kind = sorted[i].kind;
+        srecs[i].reserved = 0;
+        srecs[i].file = sorted[i].file;
+        srecs[i].line = sorted[i].line;
+    }
+
+    char dir[PATH_MAX], tmp[PATH_MAX], path[PATH_MAX];
+    int ok = strings <= UINT32_MAX &&
+             snprintf(dir, sizeof(dir), "%s/.loki", root) < (int)sizeof(dir) &&
+             snprintf(tmp, sizeof(tmp), "%s/index.%ld.tmp", dir,
+                      (long)getpid()) < (int)sizeof(tmp) &&
+             snprintf(path, sizeof(path), "%s/index", dir) < (int)sizeof(path) &&
+             (mkdir(dir, 0755) == 0 || errno == EEXIST);
+    FILE *fp = ok ? fopen(tmp, "wb") : NULL;
+    if (fp) {
+        SymHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SYMBOLS_MAGIC, sizeof(h.magic));
+        h.version = SYMBOLS_VERSION;
+        h.nfiles = (uint32_t)nfiles;
+        h.nsyms = (uint32_t)nsyms;
+        h.strings_size = strings;
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             fwrite(frecs, sizeof(*frecs), nfiles, fp) == nfiles &&
+             fwrite(srecs, sizeof(*srecs), nsyms, fp) == nsyms;
+        for (size_t i = 0; ok && i < nfiles; i++)
+            ok = fwrite(files[i].path, 1, files[i].path_len, fp) == files[i].path_len;
+        for (size_t i = 0; ok && i < nsyms; i++)
+            if (i == 0 || srecs[i].name != srecs[i - 1].name)
+                ok = fwrite(sorted[i].name, 1, sorted[i].len, fp) == sorted[i].len;
+        ok = fclose(fp) == 0 && ok;
+        if (ok) ok = rename(tmp, path) == 0;
+        if (!ok) unlink(tmp);
+    } else {
+        ok = 0;
+    }
+    free(sorted);
+    free(frecs);
+    free(srecs);
+    *nsyms_out = (long)nsyms;
+    return ok ? 0 : -1;
+}
+
+/* ======================== Jobs ======================== */
+
+static void job_event_handler(AsyncEvent *event, void *unused);
+static void start_next(uint64_t now);
+
+static void push_job_event(SymJob *job) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SYMBOLS_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+
+    /* Completion must not be lost; wait for room in the queue, unless
+     * finish_job() is waiting for us: then the main thread isn't
+     * draining it, and takes the results in itself */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&job->joining)) return;
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+    }
+}
+
+/* SYM_JOB_FILES: index the marked files. */
+static void index_files(SymJob *job) {
+    for (int i = 0; i < job->npaths && !atomic_load(&job->cancel); i++) {
+        job->out[i].path = job->paths[i];
+        job->paths[i] = NULL;
+        sym_file_index(&job->out[i], sym.real, 0, NULL);
+    }
+}
+
+/* A file found by the walk, and where its symbols come from */
+typedef struct WalkFile {
+    char *path;
+    struct stat st;
+    int mapped;             /* Its mapped entry, or -1 */
+    const SymFile *kept;    /* Its overlay entry, if current */
+    SymFile parsed;         /* Read again: parsed, or 'reuse' */
+    int read;               /* 'parsed' was filled */
+    int reuse;              /* The contents hash as mapped */
+} WalkFile;
+
+typedef struct Walk {
+    SymJob *job;
+    GrepIgnore *ignore;
+    WalkFile *files;
+    size_t count, cap;
+} Walk;
+
+/* Add the indexable files under the directory 'rel' ("" for the root). */
+static void walk_dir(Walk *w, const char *rel) {
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s%s%s", sym.real, *rel ? "/" : "",
+                 rel) >= (int)sizeof(full))
+        return;
+    DIR *d = opendir(full);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && !atomic_load(&w->job->cancel)) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+            (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+            continue;
+        char path[PATH_MAX], abs[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "",
+                     de->d_name) >= (int)sizeof(path) ||
+            snprintf(abs, sizeof(abs), "%s/%s", sym.real, path) >= (int)sizeof(abs))
+            continue;
+        struct stat st;
+        if (lstat(abs, &st) != 0) continue;     /* Symlinks are not followed */
+        int is_dir = S_ISDIR(st.st_mode);
+        if (!is_dir && !S_ISREG(st.st_mode)) continue;
+        if (grep_ignore_match(w->ignore, path, is_dir)) continue;
+        if (is_dir) {
+            walk_dir(w, path);
+            continue;
+        }
+        if (sym_lang(path) == NULL || (size_t)st.st_size > SYMBOLS_MAX_FILE) continue;
+
+        if (w->count == w->cap) {
+            size_t cap = w->cap ? w->cap * 2 : 1024;
+            WalkFile *files = realloc(w->files, sizeof(*files) * cap);
+            if (!files) {
+                perror("Out of memory");
+                exit(1);
+            }
+            w->files = files;
+            w->cap = cap;
+        }
+        WalkFile *f = &w->files[w->count++];
+        memset(f, 0, sizeof(*f));
+        f->path = strdup(path);
+        if (!f->path) {
+            perror("Out of memory");
+            exit(1);
+        }
+        f->st = st;
+    }
+    closedir(d);
+}
+
+/* Files parsed by one task of a walk */
+typedef struct WalkBatch {
+    SymJob *job;
+    WalkFile **files;
+    int count;
+} WalkBatch;
+
+static void walk_batch(void *arg) {
+    WalkBatch *b = arg;
+    for (int i = 0; i < b->count && !atomic_load(&b->job->cancel); i++) {
+        WalkFile *f = b->files[i];
+        const SymFileRec *m = f->mapped >= 0 ? &sym.map.files[f->mapped] : NULL;
+        f->parsed.path = f->path;
+        sym_file_index(&f->parsed, sym.real, m ? m->hash : 0,
+                       m ? &f->reuse : NULL);
+        f->parsed.path = NULL;
+        f->read = 1;
+    }
+}
+
+/* The mapped symbols, grouped by file: those of file i are
+ * items[start[i]..start[i + 1]). Invalid records are left out. */
+typedef struct MapGroups {
+    SymItem *items;
+    uint32_t *start;
+} MapGroups;
+
+static void map_groups(const SymMap *map, MapGroups *g) {
+    g->items = malloc(sizeof(*g->items) * (map->nsyms ? map->nsyms : 1));
+    g->start = calloc((size_t)map->nfiles + 2, sizeof(*g->start));
+    if (!g->items || !g->start) {
+        perror("Out of memory");
+        exit(1);
+    }
+    /* Counted at start[file + 2], summed into start[file + 1], then each
+     * symbol placed at start[file + 1]++: which leaves start[file] */
+    for (uint32_t i = 0; i < map->nsyms; i++) {
+        const SymRec *s = &map->syms[i];
+        if (s->file < map->nfiles && map_string(map, s->name, s->name_len))
+            g->start[s->file + 2]++;
+    }
+    for (uint32_t f = 0; f < map->nfiles; f++) g->start[f + 2] += g->start[f + 1];
+    for (uint32_t i = 0; i < map->nsyms; i++) {
+        const SymRec *s = &map->syms[i];
+        if (s->file >= map->nfiles || !map_string(map, s->name, s->name_len))
+            continue;
+        SymItem *it = &g->items[g->start[s->file + 1]++];
+        it->name = map->strings + s->name;
+        it->off = 0;
+        it->len = s->name_len;
+        it->kind = s->kind;
+        it->line = (int)s->line;
+    }
+}
+
+/* Add mapped file 'm' to the output, with its symbols as mapped. */
+static void out_mapped(SymOut *o, const MapGroups *g, uint32_t m) {
+    const SymFileRec *r = &sym.map.files[m];
+    o->path = sym.map.strings + r->path;
+    o->path_len = r->path_len;
+    o->mtime_ns = r->mtime_ns;
+    o->size = r->size;
+    o->hash = r->hash;
+    o->items = g->items + g->start[m];
+    o->count = (int)(g->start[m + 1] - g->start[m]);
+}
+
+static void out_file(SymOut *o, const SymFile *f) {
+    o->path = f->path;
+    o->path_len = strlen(f->path);
+    o->mtime_ns = f->mtime_ns;
+    o->size = f->size;
+    o->hash = f->hash;
+    o->items = f->items;
+    o->count = f->count;
+}
+
+/* SYM_JOB_WRITE: write the mapped index with the overlay over it, or
+ * what a walk of the tree finds. */
+static void write_job(SymJob *job) {
+    MapGroups g = {NULL, NULL};
+    if (sym.mapped) map_groups(&sym.map, &g);
+    SymOut *out = NULL;
+    size_t nout = 0;
+    Walk w;
+    memset(&w, 0, sizeof(w));
+    w.job = job;
+
+    if (!job->walk) {
+        out = malloc(sizeof(*out) * ((size_t)sym.map.nfiles + (size_t)sym.noverlay + 1));
+        if (!out) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (uint32_t m = 0; sym.mapped && m < sym.map.nfiles; m++)
+            if (!sym.shadowed[m] &&
+                map_string(&sym.map, sym.map.files[m].path, sym.map.files[m].path_len))
+                out_mapped(&out[nout++], &g, m);
+        for (int i = 0; i < sym.noverlay; i++)
+            if (!sym.overlay[i].gone) out_file(&out[nout++], &sym.overlay[i]);
+    } else {
+        w.ignore = grep_ignore_load(sym.real);
+        if (!w.ignore) {
+            perror("Out of memory");
+            exit(1);
+        }
+        grep_ignore_add(w.ignore, "/.loki/");
+        walk_dir(&w, "");
+        grep_ignore_free(w.ignore);
+
+        /* What is current as kept or mapped is used as it is */
+        WalkFile **todo = malloc(sizeof(*todo) * (w.count ? w.count : 1));
+        if (!todo) {
+            perror("Out of memory");
+            exit(1);
+        }
+        size_t ntodo = 0;
+        for (size_t i = 0; i < w.count; i++) {
+            WalkFile *f = &w.files[i];
+            int64_t mtime = stat_mtime_ns(&f->st);
+            int o = overlay_find(f->path);
+            f->mapped = sym.mapped ? map_find_file(&sym.map, f->path, strlen(f->path)) : -1;
+            if (o >= 0 && !sym.overlay[o].gone && sym.overlay[o].mtime_ns == mtime &&
+                sym.overlay[o].size == (int64_t)f->st.st_size) {
+                f->kept = &sym.overlay[o];
+            } else if (f->mapped >= 0 && o < 0 &&
+                       sym.map.files[f->mapped].mtime_ns == mtime &&
+                       sym.map.files[f->mapped].size == (int64_t)f->st.st_size) {
+                f->reuse = 1;
+            } else {
+                if (o >= 0) f->mapped = -1;    /* Mapped symbols are stale */
+                todo[ntodo++] = f;
+            }
+        }
+
+        /* The rest are read again, in batches on the pool */
+        size_t nbatches = (ntodo + SYMBOLS_BATCH_FILES - 1) / SYMBOLS_BATCH_FILES;
+        WalkBatch *batches = calloc(nbatches ? nbatches : 1, sizeof(*batches));
+        Task **tasks = calloc(nbatches ? nbatches : 1, sizeof(*tasks));
+        if (!batches || !tasks) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (size_t b = 0; b < nbatches; b++) {
+            batches[b].job = job;
+            batches[b].files = todo + b * SYMBOLS_BATCH_FILES;
+            batches[b].count = (int)(ntodo - b * SYMBOLS_BATCH_FILES < SYMBOLS_BATCH_FILES
+                                     ? ntodo - b * SYMBOLS_BATCH_FILES
+                                     : SYMBOLS_BATCH_FILES);
+            tasks[b] = job->pooled ? task_submit(walk_batch, &batches[b],
+                                                 TASK_PRIORITY_LOW, NULL) : NULL;
+            if (tasks[b] == NULL) walk_batch(&batches[b]);
+        }
+        for (size_t b = 0; b < nbatches; b++)
+            if (tasks[b]) task_wait(tasks[b]);
+        free(batches);
+        free(tasks);
+        free(todo);
+
+        out = malloc(sizeof(*out) * (w.count ? w.count : 1));
+        if (!out) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (size_t i = 0; i < w.count; i++) {
+            WalkFile *f = &w.files[i];
+            if (f->kept) {
+                out_file(&out[nout++], f->kept);
+            } else if (f->reuse) {
+                /* Mapped symbols, as of the file's size and mtime now */
+                out_mapped(&out[nout], &g, (uint32_t)f->mapped);
+                if (f->read) {
+                    out[nout].mtime_ns = f->parsed.mtime_ns;
+                    out[nout].size = f->parsed.size;
+                }
+                out[nout++].path = f->path;
+            } else if (f->read && !f->parsed.gone) {
+                f->parsed.path = f->path;
+                out_file(&out[nout++], &f->parsed);
+                f->parsed.path = NULL;      /* Freed as f->path */
+            }
+        }
+    }
+
+    if (!atomic_load(&job->cancel)) {
+        job->files = (long)nout;
+        job->written = write_index(sym.real, out, nout, &job->symbols) == 0;
+    }
+    for (size_t i = 0; i < w.count; i++) {
+        free(w.files[i].path);
+        sym_file_free(&w.files[i].parsed);
+    }
+    free(w.files);
+    free(out);
+    free(g.items);
+    free(g.start);
+}
+
+static void job_worker(void *arg) {
+    SymJob *job = arg;
+    if (job->kind == SYM_JOB_FILES) index_files(job);
+    else write_job(job);
+    /* Run by finish_job() itself, on the thread draining the queue */
+    if (job->pooled && !atomic_load(&job->joining)) push_job_event(job);
+}
+
+static void remap(void) {
+    char path[PATH_MAX];
+    if (sym.mapped) loader_close(&sym.map.file);
+    sym.mapped = 0;
+    free(sym.shadowed);
+    sym.shadowed = NULL;
+    memset(&sym.map, 0, sizeof(sym.map));
+    if (snprintf(path, sizeof(path), "%s/.loki/index", sym.real) < (int)sizeof(path) &&
+        map_open(&sym.map, path) == 0) {
+        sym.mapped = 1;
+        sym.shadowed = calloc((size_t)sym.map.nfiles + 1, 1);
+        if (!sym.shadowed) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+}
+
+/* Main thread: wait for the job and take its results in. */
+static void finish_job(void) {
+    SymJob *job = sym.job;
+    atomic_store(&job->joining, 1);
+    if (job->task) task_wait(job->task);
+    sym.job = NULL;
+
+    if (job->kind == SYM_JOB_FILES) {
+        int done = !atomic_load(&job->cancel);
+        for (int i = 0; i < job->npaths; i++) {
+            if (done) overlay_put(&job->out[i]);
+            else sym_file_free(&job->out[i]);
+            free(job->paths[i]);
+        }
+        sym.write_failed = 0;
+    } else if (job->written) {
+        /* The overlay, unchanged while the job ran, is in the index now */
+        overlay_clear();
+        remap();
+    } else if (!atomic_load(&job->cancel)) {
+        sym.write_failed = 1;
+    }
+    free(job->paths);
+    free(job->out);
+    free(job);
+}
+
+static void job_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    if (sym.job && sym.job->id == (int)event->data.user.i64[0]) {
+        finish_job();
+        start_next(uv_hrtime());
+    }
+}
+
+/* Run a job on the pool, or here without an event queue to report it. */
+static void start_job(SymJob *job) {
+    job->id = ++sym.next_id;
+    atomic_init(&job->cancel, 0);
+    atomic_init(&job->joining, 0);
+    sym.job = job;
+    if (async_queue_global() != NULL) {
+        if (async_queue_get_handler(NULL, SYMBOLS_ASYNC_EVENT) != job_event_handler) {
+            async_queue_set_handler_lane(NULL, SYMBOLS_ASYNC_EVENT,
+                                         job_event_handler, ASYNC_LANE_LOW);
+            async_event_set_type_name(SYMBOLS_ASYNC_EVENT, "symbols");
+        }
+        job->pooled = 1;
+        job->task = task_submit(job_worker, job, TASK_PRIORITY_LOW, NULL);
+        job->pooled = job->task != NULL;
+    }
+    if (!job->pooled) {
+        job_worker(job);
+        finish_job();
+    }
+}
+
+/* Start the job due at 'now', if none runs: the marked files, then a
+ * walk, then writing what the overlay holds. */
+static void start_next(uint64_t now) {
+    if (sym.root == NULL || sym.job) return;
+    if (sym.nmarked > 0 &&
+        now >= sym.marked_at + (uint64_t)SYMBOLS_SETTLE_MS * 1000000) {
+        SymJob *job = calloc(1, sizeof(*job));
+        if (job) job->out = calloc((size_t)sym.nmarked, sizeof(*job->out));
+        if (!job || !job->out) {
+            perror("Out of memory");
+            exit(1);
+        }
+        job->kind = SYM_JOB_FILES;
+        job->paths = sym.marked;
+        job->npaths = sym.nmarked;
+        sym.marked = NULL;
+        sym.nmarked = sym.marked_cap = 0;
+        start_job(job);
+        if (sym.job) return;
+    }
+    if (sym.walk_wanted ||
+        (sym.noverlay >= SYMBOLS_FLUSH_FILES && !sym.write_failed)) {
+        SymJob *job = calloc(1, sizeof(*job));
+        if (!job) {
+            perror("Out of memory");
+            exit(1);
+        }
+        job->kind = SYM_JOB_WRITE;
+        job->walk = sym.walk_wanted;
+        sym.walk_wanted = 0;
+        start_job(job);
+    }
+}
+
+/* ======================== Watching ======================== */
+
+static void mark(const char *rel) {
+    if (sym_lang(rel) == NULL) return;
+    sym.marked_at = uv_hrtime();
+    for (int i = 0; i < sym.nmarked; i++)
+        if (strcmp(sym.marked[i], rel) == 0) return;
+    if (sym.nmarked == sym.marked_cap) {
+        int cap = sym.marked_cap ? sym.marked_cap * 2 : 16;
+        char **m = realloc(sym.marked, sizeof(*m) * (size_t)cap);
+        if (!m) {
+            perror("Out of memory");
+            exit(1);
+        }
+        sym.marked = m;
+        sym.marked_cap = cap;
+    }
+    sym.marked[sym.nmarked] = strdup(rel);
+    if (!sym.marked[sym.nmarked]) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sym.nmarked++;
+}
+
+static void on_watch(uv_fs_event_t *handle, const char *name, int events,
+                     int status) {
+    (void)handle;
+    (void)events;
+    if (status == 0 && name && strncmp(name, ".loki", 5) != 0) mark(name);
+}
+
+static void on_watch_close(uv_handle_t *handle) {
+    free(handle);
+}
+
+/* ======================== API ======================== */
+
+int symbols_open(const char *root) {
+    char *real = realpath(root, NULL);
+    if (real == NULL) return -1;
+    if (sym.root) {
+        int same = strcmp(real, sym.real) == 0;
+        if (same) {
+            free(real);
+            return 0;
+        }
+        symbols_close();
+    }
+    sym.root = strdup(root);
+    if (!sym.root) {
+        perror("Out of memory");
+        exit(1);
+    }
+    sym.real = real;
+    sym.write_failed = 0;
+    remap();
+    if (!sym.mapped) sym.walk_wanted = 1;
+
+    sym.watch = malloc(sizeof(*sym.watch));
+    if (!sym.watch) {
+        perror("Out of memory");
+        exit(1);
+    }
+    if (uv_fs_event_init(uv_default_loop(), sym.watch) != 0) {
+        free(sym.watch);
+        sym.watch = NULL;
+    } else if (uv_fs_event_start(sym.watch, on_watch, sym.real,
+                                  UV_FS_EVENT_RECURSIVE) != 0) {
+        uv_fs_event_start(sym.watch, on_watch, sym.real, 0);
+    }
+    return 0;
+}
+
+const char *symbols_root(void) {
+    return sym.root;
+}
+
+void symbols_close(void) {
+    if (sym.root == NULL) return;
+    if (sym.job) {
+        if (sym.job->walk) atomic_store(&sym.job->cancel, 1);
+        finish_job();
+    }
+    /* The marks not indexed yet, and what the overlay keeps, go in now */
+    sym.walk_wanted = 0;
+    sym.marked_at = 0;
+    start_next(UINT64_MAX / 2);
+    if (sym.job) finish_job();
+    if (sym.noverlay > 0) {
+        SymJob *job = calloc(1, sizeof(*job));
+        if (!job) {
+            perror("Out of memory");
+            exit(1);
+        }
+        job->kind = SYM_JOB_WRITE;
+        sym.job = job;
+        job_worker(job);
+        finish_job();
+    }
+
+    if (sym.watch) uv_close((uv_handle_t *)sym.watch, on_watch_close);
+    overlay_clear();
+    free(sym.overlay);
+    for (int i = 0; i < sym.nmarked; i++) free(sym.marked[i]);
+    free(sym.marked);
+    if (sym.mapped) loader_close(&sym.map.file);
+    free(sym.shadowed);
+    free(sym.root);
+    free(sym.real);
+    int next_id = sym.next_id;
+    memset(&sym, 0, sizeof(sym));
+    sym.next_id = next_id;
+}
+
+int symbols_refresh(void) {
+    if (sym.root == NULL) return -1;
+    sym.walk_wanted = 1;
+    start_next(uv_hrtime());
+    return 0;
+}
+
+void symbols_note_file(const char *path) {
+    if (sym.root == NULL || path == NULL) return;
+    char *real = realpath(path, NULL);
+    if (real == NULL) {
+        /* Deleted: its directory still says where it was */
+        const char *slash = strrchr(path, '/');
+        char dir[PATH_MAX];
+        if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+        else snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+        char *d = realpath(dir, NULL);
+        if (d == NULL) return;
+        char buf[PATH_MAX];
+        snprintf(buf, sizeof(buf), "%s/%s", d, slash ? slash + 1 : path);
+        free(d);
+        real = strdup(buf);
+        if (!real) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    size_t n = strlen(sym.real);
+    if (strncmp(real, sym.real, n) == 0 && real[n] == '/') mark(real + n + 1);
+    free(real);
+}
+
+/* A symbol found, with what its file was indexed at */
+typedef struct SymFound {
+    Symbol s;
+    int64_t mtime_ns, size;
+} SymFound;
+
+typedef struct SymFinds {
+    SymFound *f;
+    int n, cap;
+} SymFinds;
+
+static void finds_add(SymFinds *fs, const Symbol *s, int64_t mtime_ns,
+                      int64_t size) {
+    if (fs->n == fs->cap) {
+        int cap = fs->cap ? fs->cap * 2 : 32;
+        SymFound *f = realloc(fs->f, sizeof(*f) * (size_t)cap);
+        if (!f) {
+            perror("Out of memory");
+            exit(1);
+        }
+        fs->f = f;
+        fs->cap = cap;
+    }
+    fs->f[fs->n].s = *s;
+    fs->f[fs->n].mtime_ns = mtime_ns;
+    fs->f[fs->n].size = size;
+    fs->n++;
+}
+
+static int found_cmp(const void *a, const void *b) {
+    const Symbol *x = &((const SymFound *)a)->s, *y = &((const SymFound *)b)->s;
+    int c = name_cmp(x->name, (size_t)x->name_len, y->name, (size_t)y->name_len);
+    if (c == 0) c = name_cmp(x->path, (size_t)x->path_len, y->path, (size_t)y->path_len);
+    if (c == 0) c = x->line < y->line ? -1 : x->line > y->line;
+    return c;
+}
+
+static int name_matches(const char *name, size_t len, const char *query,
+                        size_t qlen, int flags) {
+    if (flags & SYMBOLS_PREFIX) return len >= qlen && memcmp(name, query, qlen) == 0;
+    return len == qlen && memcmp(name, query, qlen) == 0;
+}
+
+int symbols_find(const char *query, int flags, Symbol *out, int max) {
+    if (sym.root == NULL) return -1;
+    if (max <= 0) return 0;
+    size_t qlen = strlen(query);
+    SymFinds fs = {NULL, 0, 0};
+    Symbol s;
+
+    /* The first 'max' of the index and of the overlay hold the first
+     * 'max' of both */
+    if (sym.mapped) {
+        for (uint32_t i = map_lower_bound(&sym.map, query, qlen);
+             i < sym.map.nsyms && fs.n < max; i++) {
+            const SymRec *r = &sym.map.syms[i];
+            const char *name = map_string(&sym.map, r->name, r->name_len);
+            if (name == NULL || r->file >= sym.map.nfiles) continue;
+            if (!name_matches(name, r->name_len, query, qlen, flags)) break;
+            if (sym.shadowed[r->file]) continue;
+            const SymFileRec *f = &sym.map.files[r->file];
+            s.path = map_string(&sym.map, f->path, f->path_len);
+            if (s.path == NULL) continue;
+            s.path_len = (int)f->path_len;
+            s.name = name;
+            s.name_len = r->name_len;
+            s.kind = r->kind;
+            s.line = (int)r->line;
+            finds_add(&fs, &s, f->mtime_ns, f->size);
+        }
+    }
+    for (int i = 0; i < sym.noverlay; i++) {
+        const SymFile *f = &sym.overlay[i];
+        for (int k = 0; k < f->count && !f->gone; k++) {
+            const SymItem *it = &f->items[k];
+            if (!name_matches(it->name, it->len, query, qlen, flags)) continue;
+            s.name = it->name;
+            s.name_len = it->len;
+            s.kind = it->kind;
+            s.path = f->path;
+            s.path_len = (int)strlen(f->path);
+            s.line = it->line;
+            finds_add(&fs, &s, f->mtime_ns, f->size);
+        }
+    }
+    if (fs.n > 1) qsort(fs.f, (size_t)fs.n, sizeof(*fs.f), found_cmp);
+    int n = fs.n < max ? fs.n : max;
+
+    /* Files changed since they were indexed are indexed again: the answer
+     * is as of the index, the next one as of the files */
+    for (int i = 0; i < n; i++) {
+        out[i] = fs.f[i].s;
+        if (i > 0 && fs.f[i].s.path == fs.f[i - 1].s.path) continue;
+        char rel[PATH_MAX], full[PATH_MAX];
+        struct stat st;
+        snprintf(rel, sizeof(rel), "%.*s", fs.f[i].s.path_len, fs.f[i].s.path);
+        if (snprintf(full, sizeof(full), "%s/%s", sym.real, rel) >= (int)sizeof(full))
+            continue;
+        if (stat(full, &st) != 0 || (int64_t)st.st_size != fs.f[i].size ||
+            stat_mtime_ns(&st) != fs.f[i].mtime_ns)
+            mark(rel);
+    }
+    free(fs.f);
+    return n;
+}
+
+const char *symbols_kind_name(int kind) {
+    /* In the order of TS_TAG_* */
+    static const char *names[] = {"function", "type", "heading"};
+    if (kind < 0 || kind >= (int)(sizeof(names) / sizeof(names[0]))) return "symbol";
+    return names[kind];
+}
+
+void symbols_counts(long *files, long *symbols) {
+    long nf = sym.mapped ? (long)sym.map.nfiles : 0;
+    long ns = sym.mapped ? (long)sym.map.nsyms : 0;
+    for (int i = 0; i < sym.noverlay; i++) {
+        int m = sym.mapped ? map_find_file(&sym.map, sym.overlay[i].path,
+                                           strlen(sym.overlay[i].path)) : -1;
+        if (m < 0 && !sym.overlay[i].gone) nf++;
+        if (m >= 0 && sym.overlay[i].gone) nf--;
+        ns += sym.overlay[i].gone ? 0 : sym.overlay[i].count;
+    }
+    /* Mapped symbols of files the overlay replaced are not counted */
+    if (sym.mapped && sym.noverlay > 0) {
+        for (uint32_t i = 0; i < sym.map.nsyms; i++)
+            if (sym.map.syms[i].file < sym.map.nfiles &&
+                sym.shadowed[sym.map.syms[i].file]) ns--;
+    }
+    *files = nf;
+    *symbols = ns;
+}
+
+int symbols_busy(void) {
+    return sym.job != NULL;
+}
+
+void symbols_wait(void) {
+    while (sym.root && (sym.job || sym.nmarked > 0 || sym.walk_wanted)) {
+        if (sym.job) finish_job();
+        sym.marked_at = 0;
+        start_next(UINT64_MAX / 2);
+    }
+}
+
+int symbols_tick(uint64_t now) {
+    if (sym.root == NULL) return -1;
+    start_next(now);
+    if (sym.job || sym.nmarked == 0) return -1;
+    uint64_t due = sym.marked_at + (uint64_t)SYMBOLS_SETTLE_MS * 1000000;
+    return due > now ? (int)((due - now + 999999) / 1000000) : 0;
+}
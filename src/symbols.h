@@ -0,0 +1,111 @@
+/* symbols.h - Project symbol index (:tag and loki.symbols())
+ *
+ * The index lists the definitions (functions, types, headings) in the
+ * files under the project root, as the tag queries of treesitter_tags()
+ * find them. It lives in .loki/index under the root, in a form used where
+ * it is mapped: a header, the files sorted by path (with the size, mtime
+ * and content hash each was indexed at), the symbols sorted by name, and
+ * the strings they point into. Opening the index maps it and checks the
+ * header, nothing more; a lookup is a binary search of the mapped
+ * symbols. However many files the project has, nothing is read or parsed
+ * at startup, and a lookup costs the same.
+ *
+ * Files are indexed again on the task pool, without a scan of the tree:
+ * - a buffer saved (symbols_note_file()), a change reported by the
+ *   root's watcher (uv_fs_event_t; recursive where the platform allows,
+ *   the root's own entries otherwise), or a file found changed since it
+ *   was indexed when a lookup returns it, marks the file; once no mark
+ *   came for SYMBOLS_SETTLE_MS the marked files are parsed again, and
+ *   their symbols kept in memory over the mapped ones;
+ * - symbols_refresh() (:tag!) walks the tree, skipping what .gitignore
+ *   does: a file whose size and mtime are as indexed keeps its symbols,
+ *   one whose content hashes the same keeps them too, only the others
+ *   are parsed, in batches of SYMBOLS_BATCH_FILES.
+ * Once SYMBOLS_FLUSH_FILES files are kept in memory, and when the editor
+ * exits, the index is written again (to a temporary file renamed over
+ * it) and mapped in place of the old one. Without an index at all, the
+ * first lookup starts the walk that builds it.
+ *
+ * Records are in the machine's byte order, as in undo_journal.h.
+ */
+
+#ifndef LOKI_SYMBOLS_H
+#define LOKI_SYMBOLS_H
+
+#include <stdint.h>
+#include "async_queue.h"
+
+/* Async event telling that an indexing job is done */
+#define SYMBOLS_ASYNC_EVENT (ASYNC_EVENT_USER + 9)
+
+/* Marked files are indexed this long after the last mark */
+#define SYMBOLS_SETTLE_MS 200
+
+/* Files indexed since the index was written, past which it is written */
+#define SYMBOLS_FLUSH_FILES 256
+
+/* Files parsed per task of a walk */
+#define SYMBOLS_BATCH_FILES 64
+
+/* Files larger than this are not parsed (generated code, data) */
+#define SYMBOLS_MAX_FILE ((size_t)4 << 20)
+
+/* Names longer than this are not indexed */
+#define SYMBOLS_MAX_NAME 255
+
+/* Flags for symbols_find() */
+#define SYMBOLS_PREFIX 1    /* Names starting with the query, not equal */
+
+/* A definition found. Strings are not NUL-terminated, and valid until the
+ * main loop runs again. */
+typedef struct Symbol {
+    const char *name;
+    int name_len;
+    int kind;               /* TS_TAG_* */
+    const char *path;       /* Relative to the root */
+    int path_len;
+    int line;               /* 1-based */
+} Symbol;
+
+/* Use the index of the project at 'root' (mapped if there is one), and
+ * watch the root. Reopening another root closes the first. Returns 0, or
+ * -1 if the root can't be resolved. */
+int symbols_open(const char *root);
+
+/* Whether an index is open, and its root as given */
+const char *symbols_root(void);
+
+/* Write what is kept in memory, stop the watch and unmap the index. */
+void symbols_close(void);
+
+/* Walk the tree, indexing what changed. A walk already running is
+ * followed by another. Returns 0, or -1 if no index is open. */
+int symbols_refresh(void);
+
+/* The file at 'path' (relative to the current directory, or absolute)
+ * changed: index it again, if it is under the root and has tags. */
+void symbols_note_file(const char *path);
+
+/* Up to 'max' symbols named 'query' (or starting with it, with
+ * SYMBOLS_PREFIX), sorted by name, then path and line, go to 'out'.
+ * Returns the number found (at most 'max'), or -1 if no index is open. */
+int symbols_find(const char *query, int flags, Symbol *out, int max);
+
+/* The name of a kind: "function", "type" or "heading" */
+const char *symbols_kind_name(int kind);
+
+/* Files and symbols in the index, as of the last job done */
+void symbols_counts(long *files, long *symbols);
+
+/* Whether a job is running */
+int symbols_busy(void);
+
+/* Wait for the jobs running or due, and take their results in. For
+ * tests. */
+void symbols_wait(void);
+
+/* Start indexing the marked files if they are due at 'now' (uv_hrtime()).
+ * Returns the milliseconds until they are, or -1 if none are marked. */
+int symbols_tick(uint64_t now);
+
+#endif /* LOKI_SYMBOLS_H */
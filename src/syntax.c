@@ -10,15 +10,24 @@
  * - Non-printable character visualization
  *
  * The highlighting is performed on the "rendered" version of each row
- * (after tab expansion) and stores highlight types in the row->hl array.
+ * (after tab expansion) and stores highlight types in the row->hl_buf.hl array.
+ * The built-in languages' rules are compiled at build time into
+ * highlighters of their own (HL_TYPE_GENERATED, see syntax/builtin.h);
+ * languages registered from Lua run the generic rules here.
  */
 
 #include "syntax.h"
 #include "languages.h"
+#include "lang_bridge.h"
+#include "trace.h"
+#include "idle.h"
+#include "spell.h"
+#include "memstats.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <uv.h>
 
 #ifdef LOKI_USE_LINENOISE
 #include "treesitter.h"
@@ -30,11 +39,207 @@ int syntax_is_separator(int c, char *separators) {
     return c == '\0' || isspace(c) || strchr(separators, c) != NULL;
 }
 
+/* ============================ Keyword table ============================= */
+
+typedef struct KeywordEntry {
+    const char *word;           /* NULL: empty slot */
+    int len;                    /* Without the trailing '|' */
+    int index;                  /* Position in syntax->keywords */
+    unsigned char hl;           /* HL_KEYWORD1 or HL_KEYWORD2 */
+} KeywordEntry;
+
+struct KeywordTable {
+    KeywordEntry *slots;        /* Open addressing, power of two */
+    unsigned int mask;
+    KeywordEntry *spanning;     /* Keywords containing separators, in order */
+    int nspanning;
+    unsigned char cclass[256];  /* SYNTAX_CC_* bits of every byte */
+    int simd_words;             /* [A-Za-z0-9_] are all SYNTAX_CC_WORD */
+};
+
+/* The highlighter used to call isspace()/strchr()/isdigit()/isprint() for
+ * every byte; the class table answers all of them with one load. Plain
+ * identifier bytes (SYNTAX_CC_WORD) cannot start a token, so runs of them
+ * are skipped in bulk: 16 bytes at a time with SSE2 when the language's
+ * word characters include all of [A-Za-z0-9_], one table load per byte
+ * otherwise. */
+
+#if defined(__GNUC__) && !defined(SYNTAX_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTAX_USE_SSE2 1
+#endif
+
+static void fill_classes(unsigned char *cclass,
+                         const struct t_editor_syntax *syntax) {
+    const char *seps = syntax->separators ? syntax->separators : "";
+    const char *leads[3] = {
+        syntax->singleline_comment_start,
+        syntax->multiline_comment_start,
+        syntax->multiline_comment_end
+    };
+
+    for (int c = 0; c < 256; c++) {
+        unsigned char cc = 0;
+        if (c == '\0' || isspace(c) || (c && strchr(seps, c))) cc |= SYNTAX_CC_SEP;
+        if (isspace(c)) cc |= SYNTAX_CC_SPACE;
+        if (isdigit(c)) cc |= SYNTAX_CC_DIGIT;
+        if (c == '"' || c == '\'') cc |= SYNTAX_CC_QUOTE;
+        if (!isprint(c)) cc |= SYNTAX_CC_NONPRINT;
+        for (int j = 0; j < 3; j++)
+            if (c && (unsigned char)leads[j][0] == c) cc |= SYNTAX_CC_COMMENT;
+        if (!(cc & (SYNTAX_CC_SEP | SYNTAX_CC_QUOTE | SYNTAX_CC_NONPRINT |
+                    SYNTAX_CC_COMMENT)))
+            cc |= SYNTAX_CC_WORD;
+        cclass[c] = cc;
+    }
+}
+
+static unsigned int keyword_hash(const char *s, int len) {
+    unsigned int h = 2166136261u;     /* FNV-1a */
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int syntax_compile_keywords(struct t_editor_syntax *syntax) {
+    if (syntax->kwtable) return 0;
+
+    int n = 0;
+    while (syntax->keywords && syntax->keywords[n]) n++;
+    unsigned int cap = 16;
+    while (cap < (unsigned int)n * 2) cap *= 2;
+
+    struct KeywordTable *t = mem_calloc(MEM_TAG_SYNTAX, 1, sizeof(*t));
+    if (t) t->slots = mem_calloc(MEM_TAG_SYNTAX, cap, sizeof(KeywordEntry));
+    if (t && n) t->spanning = mem_malloc(MEM_TAG_SYNTAX, (size_t)n * sizeof(KeywordEntry));
+    if (!t || !t->slots || (n && !t->spanning)) {
+        if (t) mem_free(MEM_TAG_SYNTAX, t->slots);
+        mem_free(MEM_TAG_SYNTAX, t);
+        return -1;
+    }
+    t->mask = cap - 1;
+
+    fill_classes(t->cclass, syntax);
+    t->simd_words = 1;
+    for (int c = 0; c < 256; c++)
+        if ((isalnum(c) || c == '_') && !(t->cclass[c] & SYNTAX_CC_WORD))
+            t->simd_words = 0;
+
+    for (int j = 0; j < n; j++) {
+        const char *w = syntax->keywords[j];
+        KeywordEntry e = { w, (int)strlen(w), j, HL_KEYWORD1 };
+        if (e.len > 0 && w[e.len-1] == '|') {    /* Trailing '|': KEYWORD2 */
+            e.len--;
+            e.hl = HL_KEYWORD2;
+        }
+        if (e.len == 0) continue;
+
+        /* A keyword running over separators is longer than the word it
+         * starts with; those few are tried one by one. */
+        int k = 0;
+        while (k < e.len && !(t->cclass[(unsigned char)w[k]] & SYNTAX_CC_SEP))
+            k++;
+        if (k < e.len) {
+            t->spanning[t->nspanning++] = e;
+            continue;
+        }
+
+        unsigned int h = keyword_hash(w, e.len) & t->mask;
+        while (t->slots[h].word &&
+               !(t->slots[h].len == e.len && !memcmp(t->slots[h].word, w, e.len)))
+            h = (h + 1) & t->mask;
+        if (!t->slots[h].word) t->slots[h] = e;   /* First duplicate wins */
+    }
+    syntax->kwtable = t;
+    return 0;
+}
+
+void syntax_free_keywords(struct t_editor_syntax *syntax) {
+    if (!syntax->kwtable) return;
+    mem_free(MEM_TAG_SYNTAX, syntax->kwtable->slots);
+    mem_free(MEM_TAG_SYNTAX, syntax->kwtable->spanning);
+    mem_free(MEM_TAG_SYNTAX, syntax->kwtable);
+    syntax->kwtable = NULL;
+}
+
+const unsigned char *syntax_char_classes(const struct t_editor_syntax *syntax) {
+    return syntax->kwtable ? syntax->kwtable->cclass : NULL;
+}
+
+/* Length of the run of SYNTAX_CC_WORD bytes at p, at most n. */
+static int word_run(const struct KeywordTable *t, const char *p, int n) {
+    int k = 0;
+#ifdef SYNTAX_USE_SSE2
+    if (t->simd_words) {
+        const __m128i fold = _mm_set1_epi8(0x20);
+        const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+        const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+        const __m128i us = _mm_set1_epi8('_');
+        for (; k + 16 <= n; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+            __m128i l = _mm_or_si128(v, fold);
+            /* Signed compares: bytes >= 0x80 are negative and match none */
+            __m128i w = _mm_and_si128(_mm_cmpgt_epi8(l, a), _mm_cmplt_epi8(l, z));
+            w = _mm_or_si128(w, _mm_and_si128(_mm_cmpgt_epi8(v, d0),
+                                              _mm_cmplt_epi8(v, d9)));
+            w = _mm_or_si128(w, _mm_cmpeq_epi8(v, us));
+            unsigned int m = (unsigned int)_mm_movemask_epi8(w);
+            if (m != 0xFFFF) {
+                k += __builtin_ctz(~m);
+                break;
+            }
+        }
+    }
+#endif
+    while (k < n && (t->cclass[(unsigned char)p[k]] & SYNTAX_CC_WORD)) k++;
+    return k;
+}
+
+/* The keyword starting at p (n chars left in the row), as the linear scan
+ * over syntax->keywords would find it, or NULL. */
+static const KeywordEntry *keyword_at(const struct KeywordTable *t,
+                                      const char *p, int n) {
+    int wlen = 0;
+    while (wlen < n && !(t->cclass[(unsigned char)p[wlen]] & SYNTAX_CC_SEP))
+        wlen++;
+
+    const KeywordEntry *best = NULL;
+    if (wlen > 0) {
+        unsigned int h = keyword_hash(p, wlen) & t->mask;
+        for (; t->slots[h].word; h = (h + 1) & t->mask) {
+            if (t->slots[h].len == wlen && !memcmp(t->slots[h].word, p, wlen)) {
+                best = &t->slots[h];
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < t->nspanning; j++) {
+        const KeywordEntry *e = &t->spanning[j];
+        if (best && e->index > best->index) break;
+        if (e->len <= n && !memcmp(e->word, p, e->len) &&
+            (e->len == n || (t->cclass[(unsigned char)p[e->len]] & SYNTAX_CC_SEP)))
+            return e;
+    }
+    return best;
+}
+
+int syntax_keyword_at(const struct t_editor_syntax *syntax, const char *p,
+                      int n, int *hl) {
+    const KeywordEntry *kw = syntax->kwtable ? keyword_at(syntax->kwtable, p, n)
+                                             : NULL;
+    if (!kw) return 0;
+    if (hl) *hl = kw->hl;
+    return kw->len;
+}
+
 /* Return true if the specified row last char is part of a multi line comment
  * that starts at this row or at one before, and does not end at the end
  * of the row but spawns to the next row. */
 int syntax_row_has_open_comment(t_erow *row) {
-    if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
+    if (row->hl_buf.hl && row->rsize &&
+        editor_row_hl_at(row, row->rsize-1) == HL_MLCOMMENT &&
         (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
                             row->render[row->rsize-1] != '/'))) return 1;
     return 0;
@@ -58,13 +263,179 @@ int syntax_name_to_code(const char *name) {
     return -1;
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void syntax_update_row(editor_ctx_t *ctx, t_erow *row) {
-    unsigned char *new_hl = realloc(row->hl,row->rsize);
-    if (new_hl == NULL) return; /* Out of memory, keep old highlighting */
-    row->hl = new_hl;
-    memset(row->hl,HL_NORMAL,row->rsize);
+/* Keyword/string/comment highlighter of HL_TYPE_C definitions (those
+ * registered from Lua); the built-in ones run the same rules compiled
+ * into their generated highlighter (syntax/hlgen.c). 'in_comment' is the
+ * open multi-line comment state carried over from the previous row. Reads
+ * no other row, so disjoint rows can be highlighted concurrently. */
+static void highlight_row_default(editor_ctx_t *ctx, t_erow *row, int in_comment) {
+    int i, prev_sep, in_string;
+    char *p;
+    char **keywords = ctx->view.syntax->keywords;
+    char *scs = ctx->view.syntax->singleline_comment_start;
+    char *mcs = ctx->view.syntax->multiline_comment_start;
+    char *mce = ctx->view.syntax->multiline_comment_end;
+    char *separators = ctx->view.syntax->separators;
+
+    /* Uncompiled definitions (out of memory, tests) classify per row */
+    const struct KeywordTable *t = ctx->view.syntax->kwtable;
+    struct KeywordTable local;
+    if (!t) {
+        memset(&local, 0, sizeof(local));
+        fill_classes(local.cclass, ctx->view.syntax);
+        t = &local;
+    }
+    const unsigned char *cc = t->cclass;
+
+    /* Point to the first non-space char. */
+    p = row->render;
+    i = 0; /* Current char offset */
+    while(*p && (cc[(unsigned char)*p] & SYNTAX_CC_SPACE)) {
+        p++;
+        i++;
+    }
+    prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
+    in_string = 0; /* Are we inside "" or '' ? */
+
+    while(*p) {
+        /* Handle single-line comments (e.g., //, #, --) */
+        if (prev_sep && scs[0] && *p == scs[0] &&
+            (scs[1] == '\0' || (i < row->rsize - 1 && *(p+1) == scs[1]))) {
+            /* From here to end is a comment */
+            memset(row->hl_buf.hl+i,HL_COMMENT,row->rsize-i);
+            break;
+        }
+
+        /* Handle multi line comments. */
+        if (in_comment) {
+            row->hl_buf.hl[i] = HL_MLCOMMENT;
+            if (i < row->rsize - 1 && *p == mce[0] && *(p+1) == mce[1]) {
+                row->hl_buf.hl[i+1] = HL_MLCOMMENT;
+                p += 2; i += 2;
+                in_comment = 0;
+                prev_sep = 1;
+                continue;
+            } else {
+                prev_sep = 0;
+                p++; i++;
+                continue;
+            }
+        } else if (i < row->rsize - 1 && *p == mcs[0] && *(p+1) == mcs[1]) {
+            row->hl_buf.hl[i] = HL_MLCOMMENT;
+            row->hl_buf.hl[i+1] = HL_MLCOMMENT;
+            p += 2; i += 2;
+            in_comment = 1;
+            prev_sep = 0;
+            continue;
+        }
+
+        /* Handle "" and '' */
+        if (in_string) {
+            row->hl_buf.hl[i] = HL_STRING;
+            if (i < row->rsize - 1 && *p == '\\') {
+                row->hl_buf.hl[i+1] = HL_STRING;
+                p += 2; i += 2;
+                prev_sep = 0;
+                continue;
+            }
+            if (*p == in_string) in_string = 0;
+            p++; i++;
+            continue;
+        } else {
+            if (cc[(unsigned char)*p] & SYNTAX_CC_QUOTE) {
+                in_string = *p;
+                row->hl_buf.hl[i] = HL_STRING;
+                p++; i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        /* Handle non printable chars. */
+        if (cc[(unsigned char)*p] & SYNTAX_CC_NONPRINT) {
+            row->hl_buf.hl[i] = HL_NONPRINT;
+            p++; i++;
+            prev_sep = 0;
+            continue;
+        }
+
+        /* Handle numbers */
+        if (((cc[(unsigned char)*p] & SYNTAX_CC_DIGIT) &&
+             (prev_sep || row->hl_buf.hl[i-1] == HL_NUMBER)) ||
+            (*p == '.' && i > 0 && row->hl_buf.hl[i-1] == HL_NUMBER &&
+             i < row->rsize - 1 && (cc[(unsigned char)*(p+1)] & SYNTAX_CC_DIGIT))) {
+            row->hl_buf.hl[i] = HL_NUMBER;
+            p++; i++;
+            prev_sep = 0;
+            continue;
+        }
+
+        /* Handle keywords and lib calls */
+        if (prev_sep && t->slots) {
+            const KeywordEntry *kw = keyword_at(t, p, row->rsize - i);
+            if (kw) {
+                memset(row->hl_buf.hl+i, kw->hl, kw->len);
+                p += kw->len;
+                i += kw->len;
+                prev_sep = 0;
+                continue;
+            }
+        } else if (prev_sep) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen-1] == '|';
+                if (kw2) klen--;
+
+                if (i + klen <= row->rsize &&
+                    !memcmp(p,keywords[j],klen) &&
+                    (i + klen == row->rsize || syntax_is_separator(*(p+klen), separators)))
+                {
+                    /* Keyword */
+                    memset(row->hl_buf.hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
+                    p += klen;
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prev_sep = 0;
+                continue; /* We had a keyword match */
+            }
+        }
+
+        /* Not special chars */
+        prev_sep = (cc[(unsigned char)*p] & SYNTAX_CC_SEP) != 0;
+        p++; i++;
+
+        /* Mid-word, outside strings and comments, the word bytes that follow
+         * can neither start a token nor end one (hl[i-1] is normal, so not
+         * even a digit is a number): leave them normal in one go. */
+        if (!prev_sep) {
+            int run = word_run(t, p, row->rsize - i);
+            p += run; i += run;
+        }
+    }
+}
+
+/* The rules of ctx's language: its generated highlighter if it has one
+ * (built-in languages), else the generic one. */
+static void highlight_rules(editor_ctx_t *ctx, t_erow *row, int in_comment) {
+    struct t_editor_syntax *syntax = ctx->view.syntax;
+    if (syntax->type == HL_TYPE_GENERATED && syntax->scan)
+        syntax->scan(row, in_comment);
+    else
+        highlight_row_default(ctx, row, in_comment);
+}
+
+/* Highlight one row, assuming the row above it is up to date. If the row's
+ * open comment state changes, the row below is marked stale rather than
+ * re-highlighted, so an edit never cascades past what is actually read. */
+static void highlight_row(editor_ctx_t *ctx, t_erow *row) {
+    editor_row_render(&ctx->model, row, &ctx->model.alloc_stats);
+    editor_row_reserve(&ctx->model, row, ROW_BUF_HL, row->rsize,
+                       &ctx->model.alloc_stats.hl);
+    memset(row->hl_buf.hl,HL_NORMAL,row->rsize);
 
     int default_ran = 0;
 
@@ -84,195 +455,345 @@ void syntax_update_row(editor_ctx_t *ctx, t_erow *row) {
             editor_update_syntax_csound(ctx, row);
             default_ran = 1;
         } else {
-            int i, prev_sep, in_string, in_comment;
-            char *p;
-            char **keywords = ctx->view.syntax->keywords;
-            char *scs = ctx->view.syntax->singleline_comment_start;
-            char *mcs = ctx->view.syntax->multiline_comment_start;
-            char *mce = ctx->view.syntax->multiline_comment_end;
-            char *separators = ctx->view.syntax->separators;
-
-            /* Point to the first non-space char. */
-            p = row->render;
-            i = 0; /* Current char offset */
-            while(*p && isspace(*p)) {
-                p++;
-                i++;
-            }
-            prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
-            in_string = 0; /* Are we inside "" or '' ? */
-            in_comment = 0; /* Are we inside multi-line comment? */
-
             /* If the previous line has an open comment, this line starts
              * with an open comment state. */
-            if (row->idx > 0 && syntax_row_has_open_comment(&ctx->model.row[row->idx-1]))
-                in_comment = 1;
-
-            while(*p) {
-                /* Handle single-line comments (e.g., //, #, --) */
-                if (prev_sep && scs[0] && *p == scs[0] &&
-                    (scs[1] == '\0' || (i < row->rsize - 1 && *(p+1) == scs[1]))) {
-                    /* From here to end is a comment */
-                    memset(row->hl+i,HL_COMMENT,row->rsize-i);
-                    break;
-                }
+            t_erow *prev = editor_row(ctx, editor_row_index(ctx, row) - 1);
+            int in_comment = 0;
+            /* A stale row above counts with the state it last ended in; if
+             * that changes when it is redone, this row is marked stale. */
+            if (prev) in_comment = prev->hl_stale ? prev->hl_oc
+                                                  : syntax_row_has_open_comment(prev);
+            highlight_rules(ctx, row, in_comment);
+            default_ran = 1;
+        }
+    }
 
-                /* Handle multi line comments. */
-                if (in_comment) {
-                    row->hl[i] = HL_MLCOMMENT;
-                    if (i < row->rsize - 1 && *p == mce[0] && *(p+1) == mce[1]) {
-                        row->hl[i+1] = HL_MLCOMMENT;
-                        p += 2; i += 2;
-                        in_comment = 0;
-                        prev_sep = 1;
-                        continue;
-                    } else {
-                        prev_sep = 0;
-                        p++; i++;
-                        continue;
-                    }
-                } else if (i < row->rsize - 1 && *p == mcs[0] && *(p+1) == mcs[1]) {
-                    row->hl[i] = HL_MLCOMMENT;
-                    row->hl[i+1] = HL_MLCOMMENT;
-                    p += 2; i += 2;
-                    in_comment = 1;
-                    prev_sep = 0;
-                    continue;
-                }
+    /* Extra highlighting (the Lua hook) runs when the row is read */
+    (void)default_ran; /* Suppress unused variable warning */
 
-                /* Handle "" and '' */
-                if (in_string) {
-                    row->hl[i] = HL_STRING;
-                    if (i < row->rsize - 1 && *p == '\\') {
-                        row->hl[i+1] = HL_STRING;
-                        p += 2; i += 2;
-                        prev_sep = 0;
-                        continue;
-                    }
-                    if (*p == in_string) in_string = 0;
-                    p++; i++;
-                    continue;
-                } else {
-                    if (*p == '"' || *p == '\'') {
-                        in_string = *p;
-                        row->hl[i] = HL_STRING;
-                        p++; i++;
-                        prev_sep = 0;
-                        continue;
-                    }
-                }
+    /* The next row was highlighted against the old comment state; it is
+     * marked stale, and read from there on if rows above it were taken
+     * for fresh. */
+    int oc = syntax_row_has_open_comment(row);
+    int at = editor_row_index(ctx, row);
+    if (row->hl_oc != oc && at >= 0 && at+1 < ctx->model.numrows) {
+        ctx->model.row[at+1].hl_stale = 1;
+        if (at + 1 < ctx->model.hl_stale_from) ctx->model.hl_stale_from = at + 1;
+    }
+    row->hl_oc = oc;
+    row->hl_stale = 0;
+    row->hl_hooked = 0;
+    editor_row_pack_hl(&ctx->model, row);
+    editor_row_damage(&ctx->model, row);
+}
 
-                /* Handle non printable chars. */
-                if (!isprint(*p)) {
-                    row->hl[i] = HL_NONPRINT;
-                    p++; i++;
-                    prev_sep = 0;
-                    continue;
-                }
+static SyntaxRowHook row_hook;
 
-                /* Handle numbers */
-                if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-                    (*p == '.' && i > 0 && row->hl[i-1] == HL_NUMBER &&
-                     i < row->rsize - 1 && isdigit(*(p+1)))) {
-                    row->hl[i] = HL_NUMBER;
-                    p++; i++;
-                    prev_sep = 0;
-                    continue;
-                }
+void syntax_set_row_hook(SyntaxRowHook hook) {
+    row_hook = hook;
+}
 
-                /* Handle keywords and lib calls */
-                if (prev_sep) {
-                    int j;
-                    for (j = 0; keywords[j]; j++) {
-                        int klen = strlen(keywords[j]);
-                        int kw2 = keywords[j][klen-1] == '|';
-                        if (kw2) klen--;
-
-                        if (i + klen <= row->rsize &&
-                            !memcmp(p,keywords[j],klen) &&
-                            (i + klen == row->rsize || syntax_is_separator(*(p+klen), separators)))
-                        {
-                            /* Keyword */
-                            memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                            p += klen;
-                            i += klen;
-                            break;
-                        }
-                    }
-                    if (keywords[j] != NULL) {
-                        prev_sep = 0;
-                        continue; /* We had a keyword match */
-                    }
-                }
+/* Pass the rows of [first, last) highlighted since the hook last saw them
+ * to the hook, one call per run of such rows; and to the spell checker,
+ * if it is on. */
+static void run_row_hook(editor_ctx_t *ctx, int first, int last) {
+    if (!row_hook && !ctx->model.spell) return;
+    if (first < 0) first = 0;
+    if (last > ctx->model.numrows) last = ctx->model.numrows;
 
-                /* Not special chars */
-                prev_sep = syntax_is_separator(*p, separators);
-                p++; i++;
-            }
+    int r = first;
+    while (r < last) {
+        if (ctx->model.row[r].hl_hooked) {
+            r++;
+            continue;
+        }
+        /* Marked first, so a hook reading rows cannot re-enter for them */
+        int end = r;
+        while (end < last && !ctx->model.row[end].hl_hooked)
+            ctx->model.row[end++].hl_hooked = 1;
+        if (row_hook) row_hook(ctx, r, end);
+        if (ctx->model.spell) spell_check_rows(ctx, r, end);
+        r = end;
+    }
+}
 
-            default_ran = 1;
+/* Reparse the document tree if it was edited, and mark the rows whose
+ * syntax changed beyond the edited ones stale. */
+static void sync_tree(editor_ctx_t *ctx) {
+#ifdef LOKI_USE_LINENOISE
+    int from, to;
+    if (ctx->model.ts_state == NULL ||
+        !treesitter_sync(ctx->model.ts_state, &ctx->model, &from, &to)) return;
+
+    for (int r = from; r < to; r++) ctx->model.row[r].hl_stale = 1;
+    if (from < ctx->model.hl_stale_from) ctx->model.hl_stale_from = from;
+#else
+    (void)ctx;
+#endif
+}
+
+/* Set every byte of row->hl_buf.hl (that corresponds to every character in
+ * the line) to the right syntax highlight type (HL_* defines). */
+void syntax_update_row(editor_ctx_t *ctx, t_erow *row) {
+    int at = editor_row_index(ctx, row);
+    sync_tree(ctx);
+    if (at > 0) syntax_fresh_row(ctx, at - 1);
+    highlight_row(ctx, row);
+    if (at >= 0 && ctx->model.hl_stale_from == at)
+        ctx->model.hl_stale_from = at + 1;
+    run_row_hook(ctx, at, at + 1);
+}
+
+#ifdef LOKI_USE_LINENOISE
+/* Highlight the stale rows in [first, last) from the document tree: rows
+ * do not depend on each other then, so fresh rows are left alone and each
+ * run of stale rows costs a single query. */
+static void highlight_tree_rows(editor_ctx_t *ctx, int first, int last) {
+    int r = first;
+
+    while (r < last) {
+        if (!ctx->model.row[r].hl_stale) {
+            r++;
+            continue;
+        }
+        int end = r;
+        for (; end < last && ctx->model.row[end].hl_stale; end++) {
+            t_erow *row = &ctx->model.row[end];
+            editor_row_render(&ctx->model, row, &ctx->model.alloc_stats);
+            editor_row_reserve(&ctx->model, row, ROW_BUF_HL, row->rsize,
+                               &ctx->model.alloc_stats.hl);
+            memset(row->hl_buf.hl, HL_NORMAL, row->rsize);
+        }
+        treesitter_update_rows(ctx, ctx->model.ts_state, r, end);
+        for (; r < end; r++) {
+            t_erow *row = &ctx->model.row[r];
+            row->hl_oc = 0;
+            row->hl_stale = 0;
+            row->hl_hooked = 0;
+            editor_row_pack_hl(&ctx->model, row);
+            editor_row_damage(&ctx->model, row);
         }
     }
+}
+#endif
 
-    /* Lua custom highlighting is in loki_editor.c */
-    (void)default_ran; /* Suppress unused variable warning */
+void syntax_invalidate_row(editor_ctx_t *ctx, t_erow *row) {
+    row->hl_stale = 1;
+    int at = editor_row_index(ctx, row);
+    if (at >= 0 && at < ctx->model.hl_stale_from)
+        ctx->model.hl_stale_from = at;
+    if (at >= 0) markdown_fences_truncate(&ctx->model, at);
+}
 
-    /* Propagate syntax change to the next row if the open comment
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
-    int oc = syntax_row_has_open_comment(row);
-    if (row->hl_oc != oc && row->idx+1 < ctx->model.numrows)
-        syntax_update_row(ctx, &ctx->model.row[row->idx+1]);
-    row->hl_oc = oc;
+/* Markdown rows depend on the rows above only through the fence index:
+ * a row is redone when it is stale or the code block it starts in has
+ * changed, and no other row is touched. */
+static int markdown_rows(editor_ctx_t *ctx) {
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) return 0;
+#endif
+    return ctx->view.syntax != NULL && ctx->view.syntax->type == HL_TYPE_MARKDOWN;
 }
 
-/* Format RGB color escape sequence for syntax highlighting.
- * Uses true color (24-bit) escape codes: ESC[38;2;R;G;Bm
- * Returns the length of the formatted string. */
-int syntax_format_color(editor_ctx_t *ctx, int hl, char *buf, size_t bufsize) {
-    if (hl < 0 || hl >= 9) hl = 0;  /* Default to HL_NORMAL */
-    t_hlcolor *color = &ctx->view.colors[hl];
-    return snprintf(buf, bufsize, "\x1b[38;2;%d;%d;%dm",
-                    color->r, color->g, color->b);
+static void highlight_markdown_rows(editor_ctx_t *ctx, int first, int last) {
+    for (int r = first; r < last; r++) {
+        t_erow *row = &ctx->model.row[r];
+        if (row->hl_stale || row->cb_entry != markdown_entry_state(ctx, r))
+            highlight_row(ctx, row);
+    }
 }
 
-/* Select the syntax highlight scheme depending on the filename. */
-void syntax_select_for_filename(editor_ctx_t *ctx, char *filename) {
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct t_editor_syntax *s = HLDB+j;
-        if (!s->filematch) continue;
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            char *p;
-            int patlen = strlen(s->filematch[i]);
-            if ((p = strstr(filename,s->filematch[i])) != NULL) {
-                if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-                    ctx->view.syntax = s;
-                    return;
-                }
-            }
-            i++;
+/* Re-highlight the stale rows from model.hl_stale_from down to 'at', in
+ * order; each may mark the row below it stale in turn. With a 'deadline'
+ * (uv_hrtime(), 0: none) the clock is read every SYNTAX_CHECKPOINT_ROWS
+ * rows, where the work stops early if it has passed; hl_stale_from keeps
+ * the row to resume from. Returns 1 once rows up to 'at' are fresh. */
+static int catch_up(editor_ctx_t *ctx, int at, uint64_t deadline) {
+    int r = ctx->model.hl_stale_from;
+    while (r <= at) {
+        int stop = r + SYNTAX_CHECKPOINT_ROWS;
+        if (stop > at + 1) stop = at + 1;
+        for (; r < stop; r++) {
+            if (ctx->model.row[r].hl_stale)
+                highlight_row(ctx, &ctx->model.row[r]);
         }
+        ctx->model.hl_stale_from = r;
+        if (deadline && r <= at && uv_hrtime() >= deadline) return 0;
     }
+    ctx->model.hl_stale_from = at + 1;
+    return 1;
+}
 
-    /* Also check dynamic language registry */
-    int dynamic_count = get_dynamic_language_count();
-    for (int j = 0; j < dynamic_count; j++) {
-        struct t_editor_syntax *s = get_dynamic_language(j);
-        if (!s || !s->filematch) continue;
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            char *p;
-            int patlen = strlen(s->filematch[i]);
-            if ((p = strstr(filename,s->filematch[i])) != NULL) {
-                if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-                    ctx->view.syntax = s;
-                    return;
-                }
-            }
-            i++;
+/* Bring row 'at' up to date. Rows above model.hl_stale_from are known to
+ * be fresh; from there down to 'at', stale rows are re-highlighted. */
+t_erow *syntax_fresh_row(editor_ctx_t *ctx, int at) {
+    t_erow *row = editor_row(ctx, at);
+    if (row == NULL) return row;
+    sync_tree(ctx);
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) {
+        highlight_tree_rows(ctx, at, at + 1);
+        run_row_hook(ctx, at, at + 1);
+        return row;
+    }
+#endif
+    if (markdown_rows(ctx))
+        highlight_markdown_rows(ctx, at, at + 1);
+    else if (at >= ctx->model.hl_stale_from)
+        catch_up(ctx, at, 0);
+    run_row_hook(ctx, at, at + 1);
+    return row;
+}
+
+/* Idle task: go on with the rows above the range syntax_fresh_rows() ran
+ * out of time on, then have the range redrawn */
+static int catch_up_step(void *arg, uint64_t deadline) {
+    editor_ctx_t *ctx = arg;
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) return IDLE_DONE;
+#endif
+    if (markdown_rows(ctx)) return IDLE_DONE;
+    int at = ctx->model.hl_idle_to;
+    if (at >= ctx->model.numrows) at = ctx->model.numrows - 1;
+    if (at < ctx->model.hl_stale_from || catch_up(ctx, at, deadline))
+        return IDLE_DONE | IDLE_DAMAGE;
+    return IDLE_MORE;
+}
+
+static void catch_up_done(void *arg) {
+    editor_ctx_t *ctx = arg;
+    ctx->model.hl_idle = 0;
+}
+
+/* syntax_fresh_rows() without the hook */
+static void fresh_rows(editor_ctx_t *ctx, int first, int last) {
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) {
+        sync_tree(ctx);
+        highlight_tree_rows(ctx, first, last);
+        return;
+    }
+#endif
+    if (markdown_rows(ctx)) {
+        highlight_markdown_rows(ctx, first, last);
+        return;
+    }
+    if (last - 1 < ctx->model.hl_stale_from ||
+        catch_up(ctx, last - 1, uv_hrtime() + SYNTAX_FRAME_BUDGET_NS))
+        return;
+
+    /* Out of time above the range: show it against the states recorded
+     * there so far, and finish in later frames. */
+    if (first < ctx->model.hl_stale_from) first = ctx->model.hl_stale_from;
+    for (int r = first; r < last; r++) {
+        if (ctx->model.row[r].hl_stale)
+            highlight_row(ctx, &ctx->model.row[r]);
+    }
+    ctx->model.hl_pending = 1;
+    ctx->model.hl_idle_to = last - 1;
+    if (!ctx->model.hl_idle)
+        ctx->model.hl_idle = idle_add(ctx, catch_up_step, catch_up_done, ctx);
+}
+
+void syntax_fresh_rows(editor_ctx_t *ctx, int first, int last) {
+    uint64_t span = trace_begin();
+    if (first < 0) first = 0;
+    if (last > ctx->model.numrows) last = ctx->model.numrows;
+    ctx->model.hl_pending = 0;
+    if (first >= last) return;
+
+    fresh_rows(ctx, first, last);
+    run_row_hook(ctx, first, last);
+    trace_end("syntax", span);
+}
+
+int syntax_pending(const editor_ctx_t *ctx) {
+    return ctx->model.hl_pending;
+}
+
+/* Only the built-in keyword highlighter is free of cross-row and global
+ * state; tree-sitter, Markdown and Csound keep per-document state. */
+int syntax_rows_thread_safe(editor_ctx_t *ctx) {
+#ifdef LOKI_USE_LINENOISE
+    if (ctx->model.ts_state != NULL) return 0;
+#endif
+    return ctx->view.syntax == NULL || ctx->view.syntax->type == HL_TYPE_C ||
+           ctx->view.syntax->type == HL_TYPE_GENERATED;
+}
+
+/* Batch highlighter for a contiguous range of rows; see syntax.h. */
+void syntax_update_rows(editor_ctx_t *ctx, int start, int end,
+                        EditorAllocStats *stats) {
+    int in_comment = 0;
+
+    for (int r = start; r < end; r++) {
+        t_erow *row = &ctx->model.row[r];
+        if (row->render == NULL) {
+            /* Rendered on demand: left stale, the rows after it redone
+             * should its comment state not be the one assumed here */
+            in_comment = 0;
+            continue;
         }
+        editor_row_reserve(&ctx->model, row, ROW_BUF_HL, row->rsize,
+                           &stats->hl);
+        memset(row->hl_buf.hl, HL_NORMAL, row->rsize);
+
+        if (ctx->view.syntax != NULL)
+            highlight_rules(ctx, row, in_comment);
+        row->hl_oc = syntax_row_has_open_comment(row);
+        row->hl_stale = 0;
+        row->hl_hooked = 0;
+        in_comment = row->hl_oc;
+        editor_row_pack_hl(&ctx->model, row);
+    }
+}
+
+/* Compile the theme into true color (24-bit) escape codes,
+ * ESC[38;2;R;G;Bm, one per HL_* constant. */
+static void build_color_sgr(editor_ctx_t *ctx) {
+    for (int hl = 0; hl < 9; hl++) {
+        t_hlcolor *color = &ctx->view.colors[hl];
+        int len = snprintf(ctx->view.color_sgr[hl], sizeof(ctx->view.color_sgr[hl]),
+                           "\x1b[38;2;%d;%d;%dm", color->r, color->g, color->b);
+        ctx->view.color_sgr_len[hl] = (unsigned char)len;
     }
+    ctx->view.color_sgr_valid = 1;
+}
+
+void syntax_colors_changed(editor_ctx_t *ctx) {
+    ctx->view.color_sgr_valid = 0;
+}
+
+const char *syntax_color_sgr(editor_ctx_t *ctx, int hl, int *len) {
+    if (hl < 0 || hl >= 9) hl = 0;  /* Default to HL_NORMAL */
+    if (!ctx->view.color_sgr_valid) build_color_sgr(ctx);
+    *len = ctx->view.color_sgr_len[hl];
+    return ctx->view.color_sgr[hl];
+}
+
+/* Copy the escape sequence of a highlight color into buf.
+ * Returns the length of the sequence. */
+int syntax_format_color(editor_ctx_t *ctx, int hl, char *buf, size_t bufsize) {
+    int len;
+    const char *sgr = syntax_color_sgr(ctx, hl, &len);
+    if (bufsize == 0) return len;
+    size_t n = (size_t)len < bufsize - 1 ? (size_t)len : bufsize - 1;
+    memcpy(buf, sgr, n);
+    buf[n] = '\0';
+    return len;
+}
+
+/* Select the syntax highlight scheme depending on the filename. The
+ * buffer's own filename goes through the model's language cache. */
+void syntax_select_for_filename(editor_ctx_t *ctx, char *filename) {
+    struct t_editor_syntax *s;
+    if (filename == ctx->model.filename)
+        s = loki_lang_resolve(ctx)->syntax;
+    else
+        s = syntax_for_filename(filename);
+    if (!s) return;
+    syntax_compile_keywords(s);
+    ctx->view.syntax = s;
 }
 
 /* Initialize default syntax highlighting colors.
@@ -297,4 +818,5 @@ void syntax_init_default_colors(editor_ctx_t *ctx) {
     ctx->view.colors[7].r = 200; ctx->view.colors[7].g = 100; ctx->view.colors[7].b = 200;
     /* HL_MATCH */
     ctx->view.colors[8].r = 100; ctx->view.colors[8].g = 150; ctx->view.colors[8].b = 220;
+    syntax_colors_changed(ctx);
 }
@@ -11,6 +11,7 @@
 #define LOKI_SYNTAX_H
 
 #include "internal.h"
+#include "syntax/builtin.h"
 
 /* Syntax highlighting functions */
 
@@ -19,14 +20,128 @@
  * syntax highlight types (HL_NORMAL, HL_KEYWORD1, HL_STRING, etc.). */
 void syntax_update_row(editor_ctx_t *ctx, t_erow *row);
 
+/* Lazy highlighting. Edits mark a row stale instead of highlighting it;
+ * code that reads row->hl_buf.hl fetches the row through syntax_fresh_row(),
+ * which re-highlights it (and any stale rows above it whose comment state
+ * it depends on) first. Only rows that are drawn or searched are ever
+ * highlighted, and a change to the comment state of one row cascades
+ * only as far as later reads reach. Markdown rows find the code block they
+ * are in from an index of the fences, so reading one never redoes the
+ * rows above it. */
+void syntax_invalidate_row(editor_ctx_t *ctx, t_erow *row);
+
+/* Return row 'at' with an up-to-date hl, or NULL if out of range. */
+t_erow *syntax_fresh_row(editor_ctx_t *ctx, int at);
+
+/* Bring rows [first, last) up to date before drawing them. With a
+ * tree-sitter tree, rows do not depend on the rows above: only the stale
+ * rows of the range are highlighted, with one query over the range, and
+ * rows outside it are not touched.
+ *
+ * Otherwise the stale rows above the range are redone first, for at most
+ * SYNTAX_FRAME_BUDGET_NS. If that is not enough (a comment opened at the
+ * top of a huge file, then a jump to its end), the range is highlighted
+ * against the comment state last recorded above it and syntax_pending()
+ * asks for another frame; each frame resumes where the last one stopped,
+ * as does an idle task between frames (see idle.h), and rows that come
+ * out different are marked stale and redrawn. */
+void syntax_fresh_rows(editor_ctx_t *ctx, int first, int last);
+
+/* Time syntax_fresh_rows() may spend per call on rows above its range, and
+ * the rows it highlights between looks at the clock. */
+#define SYNTAX_FRAME_BUDGET_NS 4000000ULL
+#define SYNTAX_CHECKPOINT_ROWS 256
+
+/* 1 if the last syntax_fresh_rows() ran out of its budget, so the rows it
+ * showed may still change: draw another frame. */
+int syntax_pending(const editor_ctx_t *ctx);
+
+/* Extra highlighting on top of the syntax rules (the Lua highlight hook).
+ * Called on the main thread with rows [first, last), each highlighted
+ * since the hook last saw it, when they are read through
+ * syntax_fresh_row(), syntax_fresh_rows() or syntax_update_row(); runs of
+ * such rows in a drawn range come in one call. The hook may change the
+ * rows' hl, through editor_row_hl() as it may be packed. NULL (the
+ * default) for none. */
+typedef void (*SyntaxRowHook)(editor_ctx_t *ctx, int first, int last);
+void syntax_set_row_hook(SyntaxRowHook hook);
+
+/* Called by syntax_for_filename() when no language matches 'filename'. It
+ * may register one that does (loki.declare_language()), and returns 1 if
+ * the registry changed and the lookup should be made again. */
+typedef int (*SyntaxMissHook)(const char *filename);
+void syntax_set_miss_hook(SyntaxMissHook hook);
+
+/* Return 1 if the current highlighter for ctx only reads the row being
+ * highlighted (no tree-sitter, Markdown or Csound state), so that
+ * syntax_update_rows() may run on worker threads. */
+int syntax_rows_thread_safe(editor_ctx_t *ctx);
+
+/* Highlight rows [start, end) in order, assuming the row before 'start'
+ * has no open multi-line comment, and without propagating past 'end'.
+ * Only valid when syntax_rows_thread_safe() is true; ranges that do not
+ * overlap may then be highlighted concurrently. The caller re-runs
+ * syntax_update_row() on 'start' if the assumption turns out wrong.
+ * Rows not rendered yet are skipped, staying stale. Allocations are
+ * counted in 'stats' rather than ctx->model.alloc_stats so that concurrent
+ * callers do not race on the counters. */
+void syntax_update_rows(editor_ctx_t *ctx, int start, int end,
+                        EditorAllocStats *stats);
+
 /* Format a syntax highlight color as an ANSI true color escape sequence.
  * Returns the length of the formatted string written to buf. */
 int syntax_format_color(editor_ctx_t *ctx, int hl, char *buf, size_t bufsize);
 
+/* The true color escape sequence of a highlight color, from a table that
+ * is compiled from view.colors on first use after a theme change.
+ * Stores its length in *len. */
+const char *syntax_color_sgr(editor_ctx_t *ctx, int hl, int *len);
+
+/* Call after changing view.colors so the escape table is rebuilt. */
+void syntax_colors_changed(editor_ctx_t *ctx);
+
 /* Select syntax highlighting scheme based on filename extension.
  * Searches both built-in HLDB and dynamic language registry. */
 void syntax_select_for_filename(editor_ctx_t *ctx, char *filename);
 
+/* Compile syntax->keywords into a hash table, so the highlighter looks up
+ * each word once instead of comparing it with every keyword, and classify
+ * all 256 byte values (SYNTAX_CC_*) for the definition. Keyword order
+ * still decides between keywords matching at the same place. Call when
+ * the definition is installed, before rows are highlighted (possibly on
+ * worker threads); a definition without a table is matched linearly.
+ * Does nothing if already compiled. Returns 0, or -1 out of memory. */
+int syntax_compile_keywords(struct t_editor_syntax *syntax);
+
+/* Free the table built by syntax_compile_keywords(). */
+void syntax_free_keywords(struct t_editor_syntax *syntax);
+
+/* Byte classes of a compiled definition */
+#define SYNTAX_CC_SEP      0x01   /* syntax_is_separator() */
+#define SYNTAX_CC_SPACE    0x02   /* isspace() */
+#define SYNTAX_CC_DIGIT    0x04   /* isdigit() */
+#define SYNTAX_CC_QUOTE    0x08   /* String delimiter: " or ' */
+#define SYNTAX_CC_COMMENT  0x10   /* First byte of a comment delimiter */
+#define SYNTAX_CC_NONPRINT 0x20   /* !isprint() */
+#define SYNTAX_CC_WORD     0x40   /* None of SEP, QUOTE, COMMENT, NONPRINT */
+
+/* The 256-entry class table of a compiled definition, indexed by
+ * (unsigned char) byte, or NULL if not compiled. */
+const unsigned char *syntax_char_classes(const struct t_editor_syntax *syntax);
+
+/* Length of the keyword of a compiled definition starting at p (n bytes
+ * left in the row), storing its HL_KEYWORD* in *hl; 0 if none matches. */
+int syntax_keyword_at(const struct t_editor_syntax *syntax, const char *p,
+                      int n, int *hl);
+
+/* Highlighters generated at build time for the languages of
+ * syntax/builtin.h: syntax_scan_c(row, in_comment), ... Each highlights
+ * row->render into row->hl_buf.hl (reserved and cleared) as the generic rules
+ * would, 'in_comment' being the open comment state of the row above. */
+#define SYNTAX_DECLARE_SCAN(name, ...) \
+    void syntax_scan_##name(t_erow *row, int in_comment);
+LOKI_GENERATED_LANGS(SYNTAX_DECLARE_SCAN)
+
 /* Map human-readable style name to HL_* constant.
  * Used by Lua API for color customization. Returns -1 if name unknown. */
 int syntax_name_to_code(const char *name);
@@ -0,0 +1,30 @@
+/* builtin.h - Built-in languages with generated highlighters
+ *
+ * The rules of these languages are compiled into specialized highlighters
+ * at build time (see hlgen.c), selected by HL_TYPE_GENERATED. Each entry
+ * gives the language's name, extensions, keywords, single-line comment
+ * start, multi-line comment start and end, and separators; HLDB is built
+ * from the same entries, so a highlighter can't drift from the rules it
+ * was generated from. Include the lang_*.h headers first.
+ */
+
+#ifndef LOKI_SYNTAX_BUILTIN_H
+#define LOKI_SYNTAX_BUILTIN_H
+
+#define LOKI_LANG_C(X) \
+    X(c, C_HL_extensions, C_HL_keywords, "//", "/*", "*/", \
+      ",.()+-/*=~%<>[]{}:;")
+#define LOKI_LANG_PYTHON(X) \
+    X(python, Python_HL_extensions, Python_HL_keywords, "#", "", "", \
+      ",.()+-/*=~%<>[]{}:;")
+#define LOKI_LANG_LUA(X) \
+    X(lua, Lua_HL_extensions, Lua_HL_keywords, "--", "", "", \
+      ",.()+-/*=~%<>[]{}:;")
+#define LOKI_LANG_SCHEME(X) \
+    X(scheme, Scheme_HL_extensions, Scheme_HL_keywords, ";", "", "", \
+      "()[]{}\"'`,@#")
+
+#define LOKI_GENERATED_LANGS(X) \
+    LOKI_LANG_C(X) LOKI_LANG_PYTHON(X) LOKI_LANG_LUA(X) LOKI_LANG_SCHEME(X)
+
+#endif /* LOKI_SYNTAX_BUILTIN_H */
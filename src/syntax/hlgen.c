@@ -0,0 +1,428 @@
+/* hlgen.c - Generate the highlighters of the built-in languages
+ *
+ * Run at build time: hlgen out.c writes, for every language of
+ * builtin.h, a function syntax_scan_<name>(row, in_comment) that
+ * highlights a row exactly as the generic rules in syntax.c would with
+ * that language's definition, but with the definition compiled in: its
+ * byte classes are a constant table, its comment delimiters are
+ * compared as constants, and its keywords are matched by nested switches
+ * on the word's bytes (a trie) instead of hashing the word and comparing
+ * it with the table's entry.
+ *
+ * Keywords are matched as syntax_compile_keywords() does: a keyword is a
+ * whole word (up to a separator); a keyword running over separators is
+ * tried at the place in the list it has, before the word's match only if
+ * it comes first in the list; of duplicates, the first wins.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lang_c.h"
+#include "lang_python.h"
+#include "lang_lua.h"
+#include "lang_scheme.h"
+#include "builtin.h"
+
+/* Byte classes, as SYNTAX_CC_* in syntax.h */
+#define CC_SEP      0x01
+#define CC_SPACE    0x02
+#define CC_DIGIT    0x04
+#define CC_QUOTE    0x08
+#define CC_COMMENT  0x10
+#define CC_NONPRINT 0x20
+#define CC_WORD     0x40
+
+typedef struct Lang {
+    const char *name;
+    char **extensions;      /* Unused: HLDB matches them */
+    char **keywords;
+    const char *scs, *mcs, *mce;
+    const char *separators;
+} Lang;
+
+#define LANG_ENTRY(name, ext, kw, scs, mcs, mce, seps) \
+    { #name, ext, kw, scs, mcs, mce, seps },
+static const Lang langs[] = { LOKI_GENERATED_LANGS(LANG_ENTRY) };
+#define NLANGS ((int)(sizeof(langs) / sizeof(langs[0])))
+
+typedef struct Keyword {
+    const char *word;
+    int len;
+    int index;              /* Position in the language's list */
+    int kw2;                /* Trailing '|': HL_KEYWORD2 */
+} Keyword;
+
+static FILE *out;
+
+/* The same as fill_classes() in syntax.c */
+static void classes(const Lang *l, unsigned char *cc) {
+    const char *leads[3] = { l->scs, l->mcs, l->mce };
+    for (int c = 0; c < 256; c++) {
+        unsigned char k = 0;
+        if (c == '\0' || isspace(c) || (c && strchr(l->separators, c))) k |= CC_SEP;
+        if (isspace(c)) k |= CC_SPACE;
+        if (isdigit(c)) k |= CC_DIGIT;
+        if (c == '"' || c == '\'') k |= CC_QUOTE;
+        if (!isprint(c)) k |= CC_NONPRINT;
+        for (int j = 0; j < 3; j++)
+            if (c && (unsigned char)leads[j][0] == c) k |= CC_COMMENT;
+        if (!(k & (CC_SEP | CC_QUOTE | CC_NONPRINT | CC_COMMENT))) k |= CC_WORD;
+        cc[c] = k;
+    }
+}
+
+/* A byte as a C expression */
+static void byte(int c) {
+    if (isprint(c) && c != '\'' && c != '\\') fprintf(out, "'%c'", c);
+    else fprintf(out, "%d", c);
+}
+
+/* A string literal of s[0..len) */
+static void literal(const char *s, int len) {
+    fputc('"', out);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (isprint(c)) fputc(c, out);
+        else fprintf(out, "\\%03o", c);
+    }
+    fputc('"', out);
+}
+
+static void indent(int depth) {
+    for (int i = 0; i < depth; i++) fputs("    ", out);
+}
+
+static void found(const Keyword *k, int depth) {
+    indent(depth);
+    fprintf(out, "{ len = %d; kh = %s; index = %d; goto found; }\n",
+            k->len, k->kw2 ? "HL_KEYWORD2" : "HL_KEYWORD1", k->index);
+}
+
+/* Match the word of 'w' bytes at p against kw[0..n), which share their
+ * first 'at' bytes and are sorted. */
+static void trie(const Keyword *kw, int n, int at, int depth) {
+    if (n == 1) {
+        indent(depth);
+        fprintf(out, "if (w == %d", kw->len);
+        if (kw->len > at) {
+            fprintf(out, " && !memcmp(p + %d, ", at);
+            literal(kw->word + at, kw->len - at);
+            fprintf(out, ", %d)", kw->len - at);
+        }
+        fputs(")\n", out);
+        found(kw, depth + 1);
+        return;
+    }
+    if (kw->len == at) {            /* Sorted: the shortest comes first */
+        indent(depth);
+        fprintf(out, "if (w == %d)\n", at);
+        found(kw, depth + 1);
+        kw++;
+        n--;
+    }
+    indent(depth);
+    fprintf(out, "if (w > %d) switch ((unsigned char)p[%d]) {\n", at, at);
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && kw[j].word[at] == kw[i].word[at]) j++;
+        indent(depth);
+        fputs("case ", out);
+        byte((unsigned char)kw[i].word[at]);
+        fputs(":\n", out);
+        trie(kw + i, j - i, at + 1, depth + 1);
+        indent(depth + 1);
+        fputs("break;\n", out);
+        i = j;
+    }
+    indent(depth);
+    fputs("}\n", out);
+}
+
+static int by_word(const void *a, const void *b) {
+    const Keyword *x = a, *y = b;
+    int n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->word, y->word, (size_t)n);
+    return c ? c : x->len - y->len;
+}
+
+/* keyword_<name>(p, n, &hl): the keyword at p (n bytes left), as
+ * keyword_at() in syntax.c finds it */
+static void emit_keywords(const Lang *l, const unsigned char *cc) {
+    int total = 0;
+    while (l->keywords && l->keywords[total]) total++;
+    Keyword *words = calloc((size_t)total + 1, sizeof(*words));
+    Keyword *spanning = calloc((size_t)total + 1, sizeof(*spanning));
+    if (!words || !spanning) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int nwords = 0, nspanning = 0;
+    for (int j = 0; j < total; j++) {
+        Keyword k = { l->keywords[j], (int)strlen(l->keywords[j]), j, 0 };
+        if (k.len > 0 && k.word[k.len - 1] == '|') {
+            k.len--;
+            k.kw2 = 1;
+        }
+        if (k.len == 0) continue;
+        int s = 0;
+        while (s < k.len && !(cc[(unsigned char)k.word[s]] & CC_SEP)) s++;
+        if (s < k.len) {
+            spanning[nspanning++] = k;
+            continue;
+        }
+        int dup = 0;
+        for (int i = 0; i < nwords; i++)
+            if (words[i].len == k.len && !memcmp(words[i].word, k.word, (size_t)k.len))
+                dup = 1;
+        if (!dup) words[nwords++] = k;
+    }
+    qsort(words, (size_t)nwords, sizeof(*words), by_word);
+
+    fprintf(out, "static int keyword_%s(const char *p, int n, int *hl) {\n", l->name);
+    if (nwords == 0 && nspanning == 0) {
+        fputs("    (void)p;\n    (void)n;\n    (void)hl;\n    return 0;\n}\n\n", out);
+        free(words);
+        free(spanning);
+        return;
+    }
+    fprintf(out, "    int len = 0, index = %d;\n", total);
+    if (nwords) {
+        fprintf(out, "    int w = 0, kh = 0;\n"
+                     "    while (w < n && !(cc_%s[(unsigned char)p[w]] & CC_SEP)) w++;\n",
+                l->name);
+        trie(words, nwords, 0, 1);
+        fputs("    goto spanning;\nfound:\n    *hl = kh;\nspanning:\n", out);
+    }
+    for (int j = 0; j < nspanning; j++) {
+        const Keyword *k = &spanning[j];
+        fprintf(out, "    if (index > %d && n >= %d && !memcmp(p, ", k->index, k->len);
+        literal(k->word, k->len);
+        fprintf(out, ", %d) &&\n        (n == %d || (cc_%s[(unsigned char)p[%d]] & CC_SEP))) {\n",
+                k->len, k->len, l->name, k->len);
+        fprintf(out, "        *hl = %s;\n        return %d;\n    }\n",
+                k->kw2 ? "HL_KEYWORD2" : "HL_KEYWORD1", k->len);
+    }
+    fputs("    (void)index;\n    return len;\n}\n\n", out);
+    free(words);
+    free(spanning);
+}
+
+/* The condition that the delimiter d (one or two bytes) starts at p */
+static void delimiter(const char *d) {
+    fputs("c == ", out);
+    byte((unsigned char)d[0]);
+    fputs(" && i < n - 1 && p[1] == ", out);
+    byte((unsigned char)d[1]);
+}
+
+static void emit_scanner(const Lang *l, const unsigned char *cc) {
+    int simd = 1;
+    for (int c = 0; c < 256; c++)
+        if ((isalnum(c) || c == '_') && !(cc[c] & CC_WORD)) simd = 0;
+
+    fprintf(out, "static const unsigned char cc_%s[256] = {", l->name);
+    for (int c = 0; c < 256; c++)
+        fprintf(out, "%s0x%02x,", c % 16 ? " " : "\n    ", cc[c]);
+    fputs("\n};\n\n", out);
+
+    fprintf(out, "static int word_run_%s(const char *p, int n) {\n", l->name);
+    fprintf(out, "    int k = %s;\n", simd ? "word_run_sse2(p, n)" : "0");
+    fprintf(out, "    while (k < n && (cc_%s[(unsigned char)p[k]] & CC_WORD)) k++;\n"
+                 "    return k;\n}\n\n", l->name);
+
+    emit_keywords(l, cc);
+
+    fprintf(out, "void syntax_scan_%s(t_erow *row, int in_comment) {\n", l->name);
+    fprintf(out,
+        "    const unsigned char *cc = cc_%s;\n"
+        "    unsigned char *hl = row->hl_buf.hl;\n"
+        "    const char *p = row->render;\n"
+        "    int n = row->rsize, i = 0, prev_sep = 1, in_string = 0;\n"
+        "\n"
+        "    while (*p && (cc[(unsigned char)*p] & CC_SPACE)) {\n"
+        "        p++;\n"
+        "        i++;\n"
+        "    }\n"
+        "    while (*p) {\n"
+        "        int c = (unsigned char)*p;\n", l->name);
+
+    if (l->scs[0]) {
+        fputs("        if (prev_sep && c == ", out);
+        byte((unsigned char)l->scs[0]);
+        if (l->scs[1]) {
+            fputs(" && i < n - 1 && p[1] == ", out);
+            byte((unsigned char)l->scs[1]);
+        }
+        fputs(") {\n"
+              "            memset(hl + i, HL_COMMENT, (size_t)(n - i));\n"
+              "            return;\n"
+              "        }\n", out);
+    }
+
+    fputs("        if (in_comment) {\n"
+          "            hl[i] = HL_MLCOMMENT;\n", out);
+    if (l->mce[0]) {
+        fputs("            if (", out);
+        delimiter(l->mce);
+        fputs(") {\n"
+              "                hl[i + 1] = HL_MLCOMMENT;\n"
+              "                p += 2;\n"
+              "                i += 2;\n"
+              "                in_comment = 0;\n"
+              "                prev_sep = 1;\n"
+              "                continue;\n"
+              "            }\n", out);
+    }
+    fputs("            prev_sep = 0;\n"
+          "            p++;\n"
+          "            i++;\n"
+          "            continue;\n"
+          "        }\n", out);
+    if (l->mcs[0]) {
+        fputs("        if (", out);
+        delimiter(l->mcs);
+        fputs(") {\n"
+              "            hl[i] = hl[i + 1] = HL_MLCOMMENT;\n"
+              "            p += 2;\n"
+              "            i += 2;\n"
+              "            in_comment = 1;\n"
+              "            prev_sep = 0;\n"
+              "            continue;\n"
+              "        }\n", out);
+    }
+
+    fprintf(out,
+        "        if (in_string) {\n"
+        "            hl[i] = HL_STRING;\n"
+        "            if (c == '\\\\' && i < n - 1) {\n"
+        "                hl[i + 1] = HL_STRING;\n"
+        "                p += 2;\n"
+        "                i += 2;\n"
+        "                prev_sep = 0;\n"
+        "                continue;\n"
+        "            }\n"
+        "            if (c == in_string) in_string = 0;\n"
+        "            p++;\n"
+        "            i++;\n"
+        "            continue;\n"
+        "        }\n"
+        "        if (c == '\"' || c == '\\'') {\n"
+        "            in_string = c;\n"
+        "            hl[i] = HL_STRING;\n"
+        "            p++;\n"
+        "            i++;\n"
+        "            prev_sep = 0;\n"
+        "            continue;\n"
+        "        }\n"
+        "        if (cc[c] & CC_NONPRINT) {\n"
+        "            hl[i] = HL_NONPRINT;\n"
+        "            p++;\n"
+        "            i++;\n"
+        "            prev_sep = 0;\n"
+        "            continue;\n"
+        "        }\n"
+        "        if (((cc[c] & CC_DIGIT) && (prev_sep || hl[i - 1] == HL_NUMBER)) ||\n"
+        "            (c == '.' && i > 0 && hl[i - 1] == HL_NUMBER && i < n - 1 &&\n"
+        "             (cc[(unsigned char)p[1]] & CC_DIGIT))) {\n"
+        "            hl[i] = HL_NUMBER;\n"
+        "            p++;\n"
+        "            i++;\n"
+        "            prev_sep = 0;\n"
+        "            continue;\n"
+        "        }\n"
+        "        if (prev_sep) {\n"
+        "            int kh, len = keyword_%s(p, n - i, &kh);\n"
+        "            if (len) {\n"
+        "                memset(hl + i, kh, (size_t)len);\n"
+        "                p += len;\n"
+        "                i += len;\n"
+        "                prev_sep = 0;\n"
+        "                continue;\n"
+        "            }\n"
+        "        }\n"
+        "        prev_sep = (cc[c] & CC_SEP) != 0;\n"
+        "        p++;\n"
+        "        i++;\n"
+        "        if (!prev_sep) {\n"
+        "            int run = word_run_%s(p, n - i);\n"
+        "            p += run;\n"
+        "            i += run;\n"
+        "        }\n"
+        "    }\n"
+        "}\n\n", l->name, l->name);
+}
+
+static const char prologue[] =
+    "/* Generated by src/syntax/hlgen.c from src/syntax/builtin.h at build\n"
+    " * time. Do not edit. */\n"
+    "\n"
+    "#include \"internal.h\"\n"
+    "#include \"syntax.h\"\n"
+    "#include <string.h>\n"
+    "\n"
+    "#if defined(__GNUC__) && !defined(SYNTAX_NO_SIMD) && defined(__SSE2__)\n"
+    "#include <emmintrin.h>\n"
+    "#define SYNTAX_USE_SSE2 1\n"
+    "#endif\n"
+    "\n"
+    "#define CC_SEP      0x01\n"
+    "#define CC_SPACE    0x02\n"
+    "#define CC_DIGIT    0x04\n"
+    "#define CC_NONPRINT 0x20\n"
+    "#define CC_WORD     0x40\n"
+    "\n"
+    "/* The bytes of [A-Za-z0-9_] at p, 16 at a time; the rest are left to\n"
+    " * the language's class table */\n"
+    "static inline int word_run_sse2(const char *p, int n) {\n"
+    "    int k = 0;\n"
+    "#ifdef SYNTAX_USE_SSE2\n"
+    "    const __m128i fold = _mm_set1_epi8(0x20);\n"
+    "    const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);\n"
+    "    const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);\n"
+    "    const __m128i us = _mm_set1_epi8('_');\n"
+    "    for (; k + 16 <= n; k += 16) {\n"
+    "        __m128i v = _mm_loadu_si128((const __m128i *)(p + k));\n"
+    "        __m128i l = _mm_or_si128(v, fold);\n"
+    "        __m128i w = _mm_and_si128(_mm_cmpgt_epi8(l, a), _mm_cmplt_epi8(l, z));\n"
+    "        w = _mm_or_si128(w, _mm_and_si128(_mm_cmpgt_epi8(v, d0),\n"
+    "                                          _mm_cmplt_epi8(v, d9)));\n"
+    "        w = _mm_or_si128(w, _mm_cmpeq_epi8(v, us));\n"
+    "        unsigned int m = (unsigned int)_mm_movemask_epi8(w);\n"
+    "        if (m != 0xFFFF) return k + __builtin_ctz(~m);\n"
+    "    }\n"
+    "#else\n"
+    "    (void)p;\n"
+    "    (void)n;\n"
+    "#endif\n"
+    "    return k;\n"
+    "}\n"
+    "\n";
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: hlgen out.c\n");
+        return 2;
+    }
+    out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    (void)Cython_HL_keywords;   /* Markdown code blocks only */
+    fputs(prologue, out);
+    for (int j = 0; j < NLANGS; j++) {
+        unsigned char cc[256];
+        classes(&langs[j], cc);
+        fprintf(out, "/* ======================= %s */\n\n", langs[j].name);
+        emit_scanner(&langs[j], cc);
+    }
+    if (fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    return 0;
+}
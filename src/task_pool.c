@@ -0,0 +1,375 @@
+/* task_pool.c - One pool of threads for the editor's background work
+ *
+ * The deques are rings under their worker's mutex: the owner pushes and
+ * pops at the bottom, thieves take from the top. A task is referenced by
+ * the deque holding it and by its handle; whoever moves it from queued
+ * to running first (a worker, or the thread waiting for it) runs it, and
+ * a worker popping one already taken just lets go of it.
+ */
+
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
+#include "task_pool.h"
+#include "async_queue.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+/* How a task came to be run, for the counters */
+enum { RUN_OWN, RUN_STOLEN, RUN_INLINE };
+
+struct Task {
+    TaskFunc fn;
+    void *arg;
+    TaskToken *token;
+    int event;                  /* task_post(): event to push, else 0 */
+    int ran;
+    atomic_int state;
+    atomic_int refs;
+};
+
+typedef struct Deque {
+    Task **items;
+    int head, count, cap;       /* items[head] is the oldest */
+} Deque;
+
+typedef struct Worker {
+    uv_thread_t thread;
+    uv_mutex_t lock;
+    Deque deques[TASK_PRIORITIES];
+    int index;
+} Worker;
+
+static struct {
+    uv_mutex_t lock;            /* Starting and stopping */
+    atomic_int started;
+    int nworkers;               /* Deques: one per thread sized for */
+    int nthreads;               /* Threads running */
+    Worker *workers;
+    uv_mutex_t sleep_lock;      /* Idle workers wait on 'wake' */
+    uv_cond_t wake;
+    uv_mutex_t done_lock;       /* Waiters wait on 'done' */
+    uv_cond_t done;
+    atomic_int queued;          /* Tasks on the deques */
+    atomic_int stopping;
+    atomic_uint next;           /* Worker the next submit from outside goes to */
+    atomic_uint_least64_t submitted, run, stolen, inlined, cancelled;
+} pool;
+
+static uv_once_t pool_once = UV_ONCE_INIT;
+static uv_key_t worker_key;     /* The pool thread's Worker, or NULL */
+static uv_key_t task_key;       /* The task running on the thread, or NULL */
+
+static void pool_once_init(void) {
+    if (uv_mutex_init(&pool.lock) != 0 || uv_mutex_init(&pool.sleep_lock) != 0 ||
+        uv_mutex_init(&pool.done_lock) != 0 || uv_cond_init(&pool.wake) != 0 ||
+        uv_cond_init(&pool.done) != 0 || uv_key_create(&worker_key) != 0 ||
+        uv_key_create(&task_key) != 0) {
+        perror("Can't set up the task pool");
+        exit(1);
+    }
+}
+
+void task_token_init(TaskToken *token) {
+    atomic_init(&token->cancelled, 0);
+}
+
+void task_token_cancel(TaskToken *token) {
+    atomic_store(&token->cancelled, 1);
+}
+
+int task_token_cancelled(const TaskToken *token) {
+    return atomic_load(&((TaskToken *)token)->cancelled);
+}
+
+int task_pool_threads(void) {
+#if UV_VERSION_HEX >= ((1 << 16) | (44 << 8))
+    int n = (int)uv_available_parallelism();
+#else
+    uv_cpu_info_t *cpus;
+    int n = 1;
+    if (uv_cpu_info(&cpus, &n) == 0) uv_free_cpu_info(cpus, n);
+#endif
+    if (n < 1) n = 1;
+    if (n > TASK_POOL_MAX_THREADS) n = TASK_POOL_MAX_THREADS;
+    return n;
+}
+
+/* ======================== Deques ======================== */
+
+static void deque_push(Deque *d, Task *t) {
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 16;
+        Task **items = malloc(sizeof(Task *) * (size_t)cap);
+        if (!items) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (int i = 0; i < d->count; i++) items[i] = d->items[(d->head + i) % d->cap];
+        free(d->items);
+        d->items = items;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->items[(d->head + d->count) % d->cap] = t;
+    d->count++;
+}
+
+static Task *deque_pop_bottom(Deque *d) {
+    if (d->count == 0) return NULL;
+    d->count--;
+    return d->items[(d->head + d->count) % d->cap];
+}
+
+static Task *deque_pop_top(Deque *d) {
+    if (d->count == 0) return NULL;
+    Task *t = d->items[d->head];
+    d->head = (d->head + 1) % d->cap;
+    d->count--;
+    return t;
+}
+
+/* The next task for 'self' (NULL: a thread outside the pool), the
+ * highest priority first: its own newest, else another's oldest */
+static Task *find_task(Worker *self, int *how) {
+    int n = pool.nworkers;
+    int start = self ? self->index : (int)(atomic_load(&pool.next) % (unsigned)n);
+    for (int p = 0; p < TASK_PRIORITIES; p++) {
+        for (int k = 0; k < n; k++) {
+            Worker *w = &pool.workers[(start + k) % n];
+            uv_mutex_lock(&w->lock);
+            Task *t = w == self ? deque_pop_bottom(&w->deques[p])
+                                : deque_pop_top(&w->deques[p]);
+            uv_mutex_unlock(&w->lock);
+            if (t) {
+                atomic_fetch_sub(&pool.queued, 1);
+                *how = w == self ? RUN_OWN : RUN_STOLEN;
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* ======================== Running ======================== */
+
+static void task_release(Task *t) {
+    if (atomic_fetch_sub(&t->refs, 1) == 1) free(t);
+}
+
+static void post_done(Task *t) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = (AsyncEventType)t->event;
+    ev.data.user.ptr = t->arg;
+    ev.data.user.i64[0] = t->ran;
+    /* Completion must not be lost; wait for room in the queue */
+    while (async_queue_push(NULL, &ev) != 0 && async_queue_global() != NULL) {
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Run 't' here unless someone else has taken it. Returns 1 if taken here. */
+static int run_task(Task *t, int how) {
+    int expected = TASK_QUEUED;
+    if (!atomic_compare_exchange_strong(&t->state, &expected, TASK_RUNNING)) return 0;
+
+    Task *outer = uv_key_get(&task_key);
+    uv_key_set(&task_key, t);
+    if (t->token && task_token_cancelled(t->token)) {
+        t->ran = 0;
+        atomic_fetch_add(&pool.cancelled, 1);
+    } else {
+        t->fn(t->arg);
+        t->ran = 1;
+        atomic_fetch_add(&pool.run, 1);
+        if (how == RUN_STOLEN) atomic_fetch_add(&pool.stolen, 1);
+        if (how == RUN_INLINE) atomic_fetch_add(&pool.inlined, 1);
+    }
+    uv_key_set(&task_key, outer);
+    if (t->event) post_done(t);
+
+    uv_mutex_lock(&pool.done_lock);
+    atomic_store(&t->state, TASK_DONE);
+    uv_cond_broadcast(&pool.done);
+    uv_mutex_unlock(&pool.done_lock);
+    return 1;
+}
+
+static void worker_main(void *arg) {
+    Worker *self = arg;
+    uv_key_set(&worker_key, self);
+    for (;;) {
+        int how;
+        Task *t = find_task(self, &how);
+        if (t) {
+            run_task(t, how);
+            task_release(t);
+            continue;
+        }
+        uv_mutex_lock(&pool.sleep_lock);
+        while (atomic_load(&pool.queued) == 0 && !atomic_load(&pool.stopping))
+            uv_cond_wait(&pool.wake, &pool.sleep_lock);
+        int stop = atomic_load(&pool.stopping) && atomic_load(&pool.queued) == 0;
+        uv_mutex_unlock(&pool.sleep_lock);
+        if (stop) break;
+    }
+    uv_key_set(&worker_key, NULL);
+}
+
+/* ======================== Starting and stopping ======================== */
+
+static void free_workers(void) {
+    for (int i = 0; i < pool.nworkers; i++) {
+        Worker *w = &pool.workers[i];
+        for (int p = 0; p < TASK_PRIORITIES; p++) free(w->deques[p].items);
+        uv_mutex_destroy(&w->lock);
+    }
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nworkers = pool.nthreads = 0;
+}
+
+/* Start the threads if they are not running. Returns how many run. */
+static int pool_start(void) {
+    uv_once(&pool_once, pool_once_init);
+    if (atomic_load(&pool.started)) return pool.nthreads;
+
+    uv_mutex_lock(&pool.lock);
+    if (!atomic_load(&pool.started)) {
+        int n = task_pool_threads();
+        atomic_store(&pool.submitted, 0);
+        atomic_store(&pool.run, 0);
+        atomic_store(&pool.stolen, 0);
+        atomic_store(&pool.inlined, 0);
+        atomic_store(&pool.cancelled, 0);
+        pool.workers = calloc((size_t)n, sizeof(Worker));
+        if (!pool.workers) {
+            perror("Out of memory");
+            exit(1);
+        }
+        pool.nworkers = n;
+        for (int i = 0; i < n; i++) {
+            pool.workers[i].index = i;
+            if (uv_mutex_init(&pool.workers[i].lock) != 0) {
+                perror("Can't set up the task pool");
+                exit(1);
+            }
+        }
+        /* Deques past the threads started are stolen from */
+        while (pool.nthreads < n &&
+               uv_thread_create(&pool.workers[pool.nthreads].thread, worker_main,
+                                &pool.workers[pool.nthreads]) == 0)
+            pool.nthreads++;
+        if (pool.nthreads > 0) atomic_store(&pool.started, 1);
+        else free_workers();
+    }
+    uv_mutex_unlock(&pool.lock);
+    return pool.nthreads;
+}
+
+void task_pool_shutdown(void) {
+    uv_once(&pool_once, pool_once_init);
+    uv_mutex_lock(&pool.lock);
+    if (atomic_load(&pool.started)) {
+        uv_mutex_lock(&pool.sleep_lock);
+        atomic_store(&pool.stopping, 1);
+        uv_cond_broadcast(&pool.wake);
+        uv_mutex_unlock(&pool.sleep_lock);
+        for (int i = 0; i < pool.nthreads; i++) uv_thread_join(&pool.workers[i].thread);
+        free_workers();
+        atomic_store(&pool.stopping, 0);
+        atomic_store(&pool.started, 0);
+    }
+    uv_mutex_unlock(&pool.lock);
+}
+
+/* ======================== Tasks ======================== */
+
+static Task *enqueue(TaskFunc fn, void *arg, int priority, TaskToken *token,
+                     int event, int refs) {
+    if (pool_start() == 0) return NULL;
+    if (priority < 0 || priority >= TASK_PRIORITIES) priority = TASK_PRIORITY_NORMAL;
+
+    Task *t = calloc(1, sizeof(*t));
+    if (!t) {
+        perror("Out of memory");
+        exit(1);
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->token = token;
+    t->event = event;
+    atomic_init(&t->state, TASK_QUEUED);
+    atomic_init(&t->refs, refs);
+
+    Worker *self = uv_key_get(&worker_key);
+    Worker *w = self ? self
+                     : &pool.workers[atomic_fetch_add(&pool.next, 1) % (unsigned)pool.nworkers];
+    uv_mutex_lock(&w->lock);
+    deque_push(&w->deques[priority], t);
+    uv_mutex_unlock(&w->lock);
+    atomic_fetch_add(&pool.queued, 1);
+    atomic_fetch_add(&pool.submitted, 1);
+
+    uv_mutex_lock(&pool.sleep_lock);
+    uv_cond_signal(&pool.wake);
+    uv_mutex_unlock(&pool.sleep_lock);
+    return t;
+}
+
+Task *task_submit(TaskFunc fn, void *arg, int priority, TaskToken *token) {
+    return enqueue(fn, arg, priority, token, 0, 2);    /* The deque's and the handle's */
+}
+
+int task_post(TaskFunc fn, void *arg, int priority, TaskToken *token, int event) {
+    if (async_queue_global() == NULL) return -1;
+    return enqueue(fn, arg, priority, token, event, 1) ? 0 : -1;
+}
+
+int task_wait(Task *task) {
+    if (!task) return 0;
+    run_task(task, RUN_INLINE);
+
+    /* Running elsewhere: a worker helps with the rest meanwhile */
+    Worker *self = uv_key_get(&worker_key);
+    while (atomic_load(&task->state) != TASK_DONE) {
+        int how;
+        Task *other = self ? find_task(self, &how) : NULL;
+        if (other) {
+            run_task(other, how);
+            task_release(other);
+            continue;
+        }
+        uv_mutex_lock(&pool.done_lock);
+        if (atomic_load(&task->state) != TASK_DONE) {
+            if (self) uv_cond_timedwait(&pool.done, &pool.done_lock, 1000000);
+            else uv_cond_wait(&pool.done, &pool.done_lock);
+        }
+        uv_mutex_unlock(&pool.done_lock);
+    }
+    int ran = task->ran;
+    task_release(task);
+    return ran;
+}
+
+int task_cancelled(void) {
+    uv_once(&pool_once, pool_once_init);
+    Task *t = uv_key_get(&task_key);
+    return t && t->token && task_token_cancelled(t->token);
+}
+
+void task_pool_stats(TaskPoolStats *stats) {
+    uv_once(&pool_once, pool_once_init);
+    stats->threads = atomic_load(&pool.started) ? pool.nthreads : 0;
+    stats->submitted = atomic_load(&pool.submitted);
+    stats->run = atomic_load(&pool.run);
+    stats->stolen = atomic_load(&pool.stolen);
+    stats->inlined = atomic_load(&pool.inlined);
+    stats->cancelled = atomic_load(&pool.cancelled);
+}
@@ -0,0 +1,91 @@
+/* task_pool.h - One pool of threads for the editor's background work
+ *
+ * Loading, searching, grepping, saving and parsing run as tasks on a
+ * single pool, sized to the machine once (task_pool_threads()), rather
+ * than each starting threads of its own: with several at work at once
+ * they share the cores instead of oversubscribing them.
+ *
+ * Each worker has a deque of tasks per priority. A task submitted from a
+ * worker goes on that worker's deques, one from any other thread on the
+ * next worker's in turn. A worker takes its own newest task first, and
+ * with none left steals the oldest of another's, the highest priority
+ * first throughout. Idle workers sleep until a task comes.
+ *
+ * task_submit() returns a handle for task_wait(), which joins the task
+ * as uv_thread_join() joins a thread: a task not started yet is run by
+ * the thread waiting for it, so a caller splitting its work into tasks
+ * and doing its share never waits on a busy pool, and a worker waiting
+ * runs other tasks meanwhile. task_post() runs one with nobody waiting
+ * and reports it through the async event queue instead. A TaskToken
+ * cancelled before a task starts keeps it from running at all; a running
+ * task may check task_cancelled() to stop early.
+ */
+
+#ifndef LOKI_TASK_POOL_H
+#define LOKI_TASK_POOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Most threads the pool starts, whatever the machine */
+#define TASK_POOL_MAX_THREADS 64
+
+/* Priorities, highest first */
+enum {
+    TASK_PRIORITY_HIGH = 0,     /* The user is waiting on it: loads, parses */
+    TASK_PRIORITY_NORMAL,       /* Saves, searches, renders */
+    TASK_PRIORITY_LOW,          /* Work ahead of need: indexes, prefetches */
+    TASK_PRIORITIES
+};
+
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct Task Task;
+
+/* Cancels the tasks given it. Owned by the caller, and must outlive them. */
+typedef struct TaskToken {
+    atomic_int cancelled;
+} TaskToken;
+
+void task_token_init(TaskToken *token);
+void task_token_cancel(TaskToken *token);
+int task_token_cancelled(const TaskToken *token);
+
+/* Counters since the pool started */
+typedef struct TaskPoolStats {
+    int threads;
+    uint64_t submitted;         /* Tasks submitted or posted */
+    uint64_t run;               /* Of those, run */
+    uint64_t stolen;            /* Run by a worker from another's deque */
+    uint64_t inlined;           /* Run by the thread waiting for them */
+    uint64_t cancelled;         /* Not run, their token cancelled first */
+} TaskPoolStats;
+
+/* Threads the pool has, or will start on first use */
+int task_pool_threads(void);
+
+/* Run fn(arg) on the pool, at 'priority', unless 'token' (or NULL) is
+ * cancelled before it starts. Returns the handle to task_wait() for, or
+ * NULL if the pool has no threads (the caller does the work itself). */
+Task *task_submit(TaskFunc fn, void *arg, int priority, TaskToken *token);
+
+/* Wait for a task to finish (running it here if it has not started),
+ * and free its handle. Returns 1 if it ran, 0 if it was cancelled. */
+int task_wait(Task *task);
+
+/* Run fn(arg) on the pool with nobody waiting (as task_submit()), then
+ * push an event of type 'event' with data.user.ptr = arg and
+ * data.user.i64[0] = 1 if it ran, 0 if cancelled. Returns 0, or -1 with
+ * no pool threads or no event queue. */
+int task_post(TaskFunc fn, void *arg, int priority, TaskToken *token, int event);
+
+/* On a task: whether its token has been cancelled. 0 elsewhere. */
+int task_cancelled(void);
+
+void task_pool_stats(TaskPoolStats *stats);
+
+/* Finish the tasks queued and stop the threads. The pool starts again on
+ * next use. */
+void task_pool_shutdown(void);
+
+#endif /* LOKI_TASK_POOL_H */
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <poll.h>
 
 /* ======================= Terminal Host State =============================== */
 
@@ -24,6 +25,9 @@ static TerminalHost g_terminal_host_instance = {0};
 /* Global pointer for signal handler access */
 TerminalHost *g_terminal_host = &g_terminal_host_instance;
 
+/* Synchronized output setting (TERM_SYNC_*) */
+static int sync_mode = TERM_SYNC_AUTO;
+
 /* ======================= Terminal Host Implementation ===================== */
 
 int terminal_host_init(TerminalHost *host, int fd) {
@@ -97,6 +101,10 @@ int terminal_host_enable_raw_mode(TerminalHost *host) {
      * Only if stdout is a terminal (not a pipe or file) */
     if (isatty(STDOUT_FILENO)) {
         (void)write(STDOUT_FILENO, "\x1b[?1049h", 8);
+        (void)write(STDOUT_FILENO, TERM_PASTE_ON, sizeof(TERM_PASTE_ON) - 1);
+        (void)write(STDOUT_FILENO, TERM_MOUSE_ON, sizeof(TERM_MOUSE_ON) - 1);
+        if (sync_mode == TERM_SYNC_AUTO)
+            host->sync_output = terminal_probe_sync_output(host->fd, STDOUT_FILENO);
     }
 
     return 0;
@@ -108,6 +116,8 @@ void terminal_host_disable_raw_mode(TerminalHost *host) {
     /* Exit alternate screen buffer (restores original terminal content)
      * Only if stdout is a terminal (not a pipe or file) */
     if (isatty(STDOUT_FILENO)) {
+        (void)write(STDOUT_FILENO, TERM_MOUSE_OFF, sizeof(TERM_MOUSE_OFF) - 1);
+        (void)write(STDOUT_FILENO, TERM_PASTE_OFF, sizeof(TERM_PASTE_OFF) - 1);
         (void)write(STDOUT_FILENO, "\x1b[?1049l", 8);
     }
 
@@ -125,90 +135,302 @@ void terminal_host_clear_resize(TerminalHost *host) {
 
 /* ======================= Input Reading ==================================== */
 
+/* Input read ahead of the keys parsed from it: one read() takes whatever
+ * is waiting, so a burst of typing or a paste is a handful of syscalls
+ * rather than one per byte. It belongs to the descriptor last read. */
+static struct {
+    int fd;
+    size_t at, len;
+    char buf[TERM_INPUT_SIZE];
+    int has_unread, unread;     /* A key given back, read before the rest */
+} input = { -1, 0, 0, {0}, 0, 0 };
+
+/* The text of the last bracketed paste (see terminal_paste()) */
+static struct {
+    char *text;
+    size_t len, cap;
+} paste;
+
+/* The last mouse report read (see terminal_mouse()) */
+static TermMouse mouse;
+
+/* Where the keys read are recorded, see terminal_record_keys() */
+static FILE *key_trace;
+
+static void input_select(int fd) {
+    if (input.fd == fd) return;
+    input.fd = fd;
+    input.at = input.len = 0;
+    input.has_unread = 0;
+}
+
+/* Read what is waiting on 'fd' after the buffered input. Returns the bytes
+ * read, 0 on timeout (or EOF, or a full buffer), -1 on error. */
+static int input_fill(int fd) {
+    if (input.at > 0) {
+        memmove(input.buf, input.buf + input.at, input.len - input.at);
+        input.len -= input.at;
+        input.at = 0;
+    }
+    if (input.len == sizeof(input.buf)) return 0;
+    ssize_t n = read(fd, input.buf + input.len, sizeof(input.buf) - input.len);
+    if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    input.len += (size_t)n;
+    return (int)n;
+}
+
+/* The byte 'i' past the next one to parse, read if it has not come yet.
+ * Returns -1 if it does not come within the read timeout. */
+static int input_peek(int fd, size_t i) {
+    if (input.at + i >= input.len && (input_fill(fd) <= 0 || input.at + i >= input.len))
+        return -1;
+    return (unsigned char)input.buf[input.at + i];
+}
+
+static void paste_append(const char *s, size_t len) {
+    if (paste.len + len > paste.cap) {
+        size_t cap = paste.cap ? paste.cap : TERM_INPUT_SIZE;
+        while (cap < paste.len + len) cap *= 2;
+        char *text = realloc(paste.text, cap);
+        if (!text) {
+            perror("Out of memory");
+            exit(1);
+        }
+        paste.text = text;
+        paste.cap = cap;
+    }
+    memcpy(paste.text + paste.len, s, len);
+    paste.len += len;
+}
+
+/* Gather a bracketed paste, its start (CSI 200~) already read, up to the
+ * CSI 201~ that ends it. The text is taken in bulk from the input, and
+ * what came after the end marker goes back to be parsed as keys. A paste
+ * whose end never comes is cut short after TERM_PASTE_RETRIES empty reads.
+ * Line breaks come as CR (or CR LF) and are stored as LF. */
+static void read_paste(int fd) {
+    static const char end[] = "\x1b[201~";
+    const size_t end_len = sizeof(end) - 1;
+    int retries = 0;
+
+    paste.len = 0;
+    while (1) {
+        if (input.at < input.len) {
+            size_t from = paste.len >= end_len ? paste.len - end_len + 1 : 0;
+            paste_append(input.buf + input.at, input.len - input.at);
+            input.at = input.len = 0;
+
+            char *p = paste.text + from, *stop = paste.text + paste.len;
+            while ((p = memchr(p, ESC, (size_t)(stop - p))) != NULL) {
+                if ((size_t)(stop - p) >= end_len && memcmp(p, end, end_len) == 0) break;
+                p++;
+            }
+            if (p) {
+                input.len = (size_t)(stop - p) - end_len;
+                memcpy(input.buf, p + end_len, input.len);
+                paste.len = (size_t)(p - paste.text);
+                break;
+            }
+        }
+        int n = input_fill(fd);
+        if (n < 0 || (n == 0 && ++retries > TERM_PASTE_RETRIES)) break;
+        if (n > 0) retries = 0;
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < paste.len; i++) {
+        char c = paste.text[i];
+        if (c == '\r') {
+            if (i + 1 < paste.len && paste.text[i + 1] == '\n') i++;
+            c = '\n';
+        }
+        paste.text[out++] = c;
+    }
+    paste.len = out;
+}
+
+/* An SGR mouse report, CSI < b ; x ; y M (or m), 'params' from the '<'.
+ * Returns MOUSE_KEY, or -1 if it is not three numbers. */
+static int read_mouse(const char *params, size_t len, int final) {
+    int v[3] = {0, 0, 0}, n = 0;
+    for (size_t i = 1; i < len; i++) {
+        char c = params[i];
+        if (c == ';' && n < 2) n++;
+        else if (c >= '0' && c <= '9' && v[n] < 100000) v[n] = v[n] * 10 + c - '0';
+        else return -1;
+    }
+    if (n != 2) return -1;
+    mouse.button = v[0];
+    mouse.x = v[1];
+    mouse.y = v[2];
+    mouse.release = final == 'm';
+    return MOUSE_KEY;
+}
+
+/* The key of CSI 'params' 'final', or -1 for a sequence that is not one */
+static int csi_key(int fd, const char *params, size_t len, int final) {
+#define PARAMS_ARE(s) (len == sizeof(s) - 1 && memcmp(params, s, len) == 0)
+    if (len > 0 && params[0] == '<') {
+        return final == 'M' || final == 'm' ? read_mouse(params, len, final) : -1;
+    } else if (len == 0) {
+        switch (final) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        }
+    } else if (final == '~') {
+        if (PARAMS_ARE("3")) return DEL_KEY;
+        if (PARAMS_ARE("5")) return PAGE_UP;
+        if (PARAMS_ARE("6")) return PAGE_DOWN;
+        if (PARAMS_ARE("200")) {
+            read_paste(fd);
+            return PASTE_KEY;
+        }
+    } else if (PARAMS_ARE("1;2")) {
+        /* ESC[1;2X for Shift+Arrow */
+        switch (final) {
+        case 'A': return SHIFT_ARROW_UP;
+        case 'B': return SHIFT_ARROW_DOWN;
+        case 'C': return SHIFT_ARROW_RIGHT;
+        case 'D': return SHIFT_ARROW_LEFT;
+        }
+    } else if (PARAMS_ARE("13;2") && final == 'u') {
+        /* ESC[13;2u - Shift+Return (kitty keyboard protocol) */
+        return SHIFT_RETURN;
+    }
+    return -1;
+#undef PARAMS_ARE
+}
+
+/* Parse the escape sequence at the head of the input, reading the rest of
+ * it as needed. Returns its key, or -1 for a whole sequence that is not a
+ * key (skipped). An ESC not followed in time by a sequence is the ESC key
+ * on its own, and whatever follows it is parsed as keys of its own. */
+static int read_escape(int fd) {
+    int c = input_peek(fd, 1);
+    if (c == '[') {
+        /* Parameter and intermediate bytes, then the final byte */
+        size_t i = 2;
+        while ((c = input_peek(fd, i)) >= 0x20 && c <= 0x3f && i < TERM_CSI_MAX) i++;
+        if (c >= 0x40 && c <= 0x7e) {
+            const char *params = input.buf + input.at + 2;
+            input.at += i + 1;
+            return csi_key(fd, params, i - 2, c);
+        }
+    } else if (c == 'O') {
+        c = input_peek(fd, 2);
+        if (c >= 0) {
+            input.at += 3;
+            if (c == 'H') return HOME_KEY;
+            if (c == 'F') return END_KEY;
+            return -1;
+        }
+    }
+    input.at++;
+    return ESC;
+}
+
+int terminal_input_pending(int fd) {
+    return input.fd == fd && (input.has_unread || input.at < input.len);
+}
+
+int terminal_input_interrupted(int fd) {
+    if (input.fd != fd && input.fd != -1) return 0;
+    input_select(fd);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    if (poll(&pfd, 1, 0) > 0 && input_fill(fd) < 0) return 0;
+
+    char *c = memchr(input.buf + input.at, CTRL_C, input.len - input.at);
+    if (!c) return 0;
+    memmove(c, c + 1, (size_t)(input.buf + input.len - c - 1));
+    input.len--;
+    return 1;
+}
+
+int terminal_wait_input(int fd, int timeout_ms) {
+    if (terminal_input_pending(fd)) return 1;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    return n > 0;
+}
+
+int terminal_record_keys(const char *path) {
+    if (key_trace) fclose(key_trace);
+    key_trace = NULL;
+    if (!path) return 0;
+    key_trace = fopen(path, "w");
+    if (!key_trace) return -1;
+    fprintf(key_trace, "# loki key trace\n");
+    return 0;
+}
+
+static int record_key(int key) {
+    if (!key_trace) return key;
+    if (key == PASTE_KEY) {
+        fprintf(key_trace, "paste %zu\n", paste.len);
+        fwrite(paste.text, 1, paste.len, key_trace);
+        fputc('\n', key_trace);
+    } else if (key == MOUSE_KEY) {
+        fprintf(key_trace, "mouse %d %d %d%s\n", mouse.button, mouse.x, mouse.y,
+                mouse.release ? " m" : "");
+    } else {
+        fprintf(key_trace, "%d\n", key);
+    }
+    fflush(key_trace);  /* Kept if the editor is killed */
+    return key;
+}
+
 /* Read a key from the terminal put in raw mode, trying to handle
  * escape sequences. */
 int terminal_read_key(int fd) {
-    int nread;
-    char c, seq[6];
-    int retries = 0;
-    /* Wait for input with timeout. If we get too many consecutive
-     * zero-byte reads, stdin may be closed. */
-    while ((nread = read(fd, &c, 1)) == 0) {
-        if (++retries > 1000) {
-            /* After ~100 seconds of no input, assume stdin is closed */
-            fprintf(stderr, "\nNo input received, exiting.\n");
-            exit(0);
-        }
+    input_select(fd);
+    if (input.has_unread) {
+        input.has_unread = 0;
+        return input.unread;
     }
-    if (nread == -1) exit(1);
-
-    while(1) {
-        switch(c) {
-        case ESC:    /* escape sequence */
-            /* If this is just an ESC, we'll timeout here. */
-            if (read(fd, seq, 1) == 0) return ESC;
-            if (read(fd, seq+1, 1) == 0) return ESC;
-
-            /* ESC [ sequences. */
-            if (seq[0] == '[') {
-                if (seq[1] >= '0' && seq[1] <= '9') {
-                    /* Extended escape, read additional byte. */
-                    if (read(fd, seq+2, 1) == 0) return ESC;
-                    if (seq[2] == '~') {
-                        switch(seq[1]) {
-                        case '3': return DEL_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        }
-                    } else if (seq[2] == ';') {
-                        /* ESC[1;2X for Shift+Arrow */
-                        if (read(fd, seq+3, 1) == 0) return ESC;
-                        if (read(fd, seq+4, 1) == 0) return ESC;
-                        if (seq[1] == '1' && seq[3] == '2') {
-                            switch(seq[4]) {
-                            case 'A': return SHIFT_ARROW_UP;
-                            case 'B': return SHIFT_ARROW_DOWN;
-                            case 'C': return SHIFT_ARROW_RIGHT;
-                            case 'D': return SHIFT_ARROW_LEFT;
-                            }
-                        }
-                    } else if (seq[1] == '1' && seq[2] == '3') {
-                        /* ESC[13;2u - Shift+Return (kitty keyboard protocol) */
-                        if (read(fd, seq+3, 1) == 0) return ESC;
-                        if (seq[3] == ';') {
-                            if (read(fd, seq+4, 1) == 0) return ESC;
-                            if (read(fd, seq+5, 1) == 0) return ESC;
-                            if (seq[4] == '2' && seq[5] == 'u') {
-                                return SHIFT_RETURN;
-                            }
-                        }
-                    }
-                } else {
-                    switch(seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                    }
-                }
+    while (1) {
+        int retries = 0;
+        /* Wait for input with timeout. If we get too many consecutive
+         * zero-byte reads, stdin may be closed. */
+        while (input.at == input.len) {
+            int n = input_fill(fd);
+            if (n < 0) exit(1);
+            if (n == 0 && ++retries > 1000) {
+                /* After ~100 seconds of no input, assume stdin is closed */
+                fprintf(stderr, "\nNo input received, exiting.\n");
+                exit(0);
             }
+        }
 
-            /* ESC O sequences. */
-            else if (seq[0] == 'O') {
-                switch(seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-                }
-            }
-            break;
-        default:
-            return c;
+        char c = input.buf[input.at];
+        if (c != ESC) {
+            input.at++;
+            return record_key(c);
         }
+        int key = read_escape(fd);
+        if (key != -1) return record_key(key);
     }
 }
 
+void terminal_unread_key(int fd, int key) {
+    input_select(fd);
+    input.has_unread = 1;
+    input.unread = key;
+}
+
+const TermMouse *terminal_mouse(void) {
+    return &mouse;
+}
+
+const char *terminal_paste(size_t *len) {
+    if (len) *len = paste.len;
+    return paste.text ? paste.text : "";
+}
+
 /* ======================= Window Size Detection ============================ */
 
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
@@ -314,8 +536,12 @@ void terminal_handle_resize(editor_ctx_t *ctx) {
 
 /* ======================= Screen Buffer ==================================== */
 
-void terminal_buffer_append(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+void terminal_buffer_reserve(struct abuf *ab, int need) {
+    if (need <= ab->cap) return;
+
+    int newcap = ab->cap ? ab->cap : TERM_ABUF_MIN_CAP;
+    while (newcap < need) newcap *= 2;
+    char *new = realloc(ab->b, newcap);
 
     if (new == NULL) {
         /* Out of memory - attempt to restore terminal and exit cleanly */
@@ -324,11 +550,87 @@ void terminal_buffer_append(struct abuf *ab, const char *s, int len) {
         perror("Out of memory during screen refresh");
         exit(1);
     }
-    memcpy(new + ab->len, s, len);
     ab->b = new;
+    ab->cap = newcap;
+}
+
+void terminal_buffer_append(struct abuf *ab, const char *s, int len) {
+    terminal_buffer_reserve(ab, ab->len + len);
+    memcpy(ab->b + ab->len, s, len);
     ab->len += len;
 }
 
 void terminal_buffer_free(struct abuf *ab) {
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+/* ======================= Frame Output ===================================== */
+
+void terminal_set_sync_mode(int mode) {
+    sync_mode = mode;
+}
+
+int terminal_get_sync_mode(void) {
+    return sync_mode;
+}
+
+int terminal_sync_enabled(void) {
+    if (sync_mode == TERM_SYNC_AUTO)
+        return g_terminal_host != NULL && g_terminal_host->sync_output;
+    return sync_mode == TERM_SYNC_ON;
+}
+
+void terminal_sync_begin(struct abuf *ab) {
+    if (terminal_sync_enabled()) terminal_buffer_append(ab, TERM_SYNC_BEGIN, 8);
+}
+
+void terminal_sync_end(struct abuf *ab) {
+    if (terminal_sync_enabled()) terminal_buffer_append(ab, TERM_SYNC_END, 8);
+}
+
+int terminal_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Non-blocking output (e.g. a shared pty): wait for room */
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return -1;
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Ask the terminal whether it knows DEC private mode 2026 with DECRQM.
+ * A primary device attributes request follows, which every terminal
+ * answers, so the read ends promptly even when DECRQM is ignored.
+ * Returns 1 if synchronized output is supported. */
+int terminal_probe_sync_output(int ifd, int ofd) {
+    static const char query[] = "\x1b[?2026$p\x1b[c";
+    char buf[128];
+    size_t i = 0;
+
+    if (write(ofd, query, sizeof(query) - 1) != (ssize_t)(sizeof(query) - 1))
+        return 0;
+
+    /* Read up to the 'c' ending the device attributes reply */
+    while (i < sizeof(buf) - 1) {
+        if (read(ifd, buf + i, 1) != 1) break;  /* VTIME timeout */
+        if (buf[i++] == 'c') break;
+    }
+    buf[i] = '\0';
+
+    /* Reply: ESC [ ? 2026 ; Ps $ y, Ps 1 (set) or 2 (reset) if known */
+    const char *p = strstr(buf, "\x1b[?2026;");
+    if (p == NULL) return 0;
+    p += 8;
+    return (*p == '1' || *p == '2') && p[1] == '$';
 }
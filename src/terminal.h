@@ -17,14 +17,83 @@
 
 /* ======================= Input Reading ==================================== */
 
+/* Input is read TERM_INPUT_SIZE bytes at a time at most, and buffered
+ * until keys are parsed from it. */
+#define TERM_INPUT_SIZE 4096
+
+/* Longest CSI sequence parsed as a key; longer ones read as ESC and text */
+#define TERM_CSI_MAX 32
+
+/* Bracketed paste (DEC private mode 2004): the terminal wraps pasted text
+ * in CSI 200~ ... CSI 201~, so it is told apart from typing. On while raw
+ * mode is. */
+#define TERM_PASTE_ON  "\x1b[?2004h"
+#define TERM_PASTE_OFF "\x1b[?2004l"
+
+/* Empty reads (of the raw mode timeout, 100 ms) a paste waits for its end */
+#define TERM_PASTE_RETRIES 10
+
+/* Mouse reporting: presses and releases (1000), motion with a button held
+ * (1002), reported as SGR sequences CSI < b ; x ; y M (m on release, 1006)
+ * that have no limit on x and y. On while raw mode is; Shift bypasses it in
+ * most terminals, for their own selection. */
+#define TERM_MOUSE_ON  "\x1b[?1000h\x1b[?1002h\x1b[?1006h"
+#define TERM_MOUSE_OFF "\x1b[?1006l\x1b[?1002l\x1b[?1000l"
+
+/* A mouse report, as sent: 'button' is the SGR code, its low two bits the
+ * button (0 left, 1 middle, 2 right), plus 4 with Shift, 8 with Alt, 16
+ * with Ctrl, 32 for motion, and 64 for the wheel (64 up, 65 down). The
+ * cell is 1-based. */
+typedef struct {
+    int button;
+    int x, y;
+    int release;               /* Ended by 'm': a button let go */
+} TermMouse;
+
 /* Read a single key from the terminal, handling escape sequences.
  * Blocks until a key is available or timeout occurs.
  * Returns:
  *   - ASCII value for normal keys (0-127)
  *   - KEY_* constants for special keys (arrows, function keys, etc.)
+ *   - PASTE_KEY for a bracketed paste, its text in terminal_paste()
+ *   - MOUSE_KEY for a mouse report, in terminal_mouse()
  *   - Exits on EOF after timeout */
 int terminal_read_key(int fd);
 
+/* Record every key read from now on to 'path' (NULL: stop recording), as
+ * a key trace: one keycode per line in decimal, "#" lines comments, and a
+ * paste as "paste N", then the N bytes of its text and a newline, and a
+ * mouse report as "mouse B X Y" with an "m" after it on release. See
+ * event_source_replay(). Returns 0, or -1 with errno set. */
+int terminal_record_keys(const char *path);
+
+/* Give back 'key', read from fd, for the next terminal_read_key() to
+ * return. One key at most: a lookahead. */
+void terminal_unread_key(int fd, int key);
+
+/* The report terminal_read_key() last returned MOUSE_KEY for */
+const TermMouse *terminal_mouse(void);
+
+/* The text of the paste terminal_read_key() last returned PASTE_KEY for,
+ * its line breaks as LF, and its length in *len. Valid until the next
+ * paste; not NUL-terminated. */
+const char *terminal_paste(size_t *len);
+
+/* Is input from fd already read and buffered, so terminal_read_key()
+ * will not wait and a poll() of fd would not see it? */
+int terminal_input_pending(int fd);
+
+/* Has Ctrl-C been typed on fd, in the input buffered or waiting (read
+ * without blocking)? The Ctrl-C is taken out of the input, the keys
+ * around it are left to be read. For long work that the user can stop.
+ * Always 0 if keys are being read from another fd. */
+int terminal_input_interrupted(int fd);
+
+/* Wait up to timeout_ms (-1: forever, 0: just check) for input on fd.
+ * Returns 1 if a read would not block (or input is buffered), 0 on
+ * timeout or signal (e.g. a SIGWINCH), -1 on error. */
+int terminal_wait_input(int fd, int timeout_ms);
+
 /* ======================= Window Size Detection ============================ */
 
 /* Get current terminal window size in rows and columns.
@@ -55,9 +124,49 @@ void terminal_handle_resize(editor_ctx_t *ctx);
  * Exits on allocation failure after attempting cleanup. */
 void terminal_buffer_append(struct abuf *ab, const char *s, int len);
 
+/* Make room for 'need' bytes in total. Buffers are meant to be reused
+ * across frames (reset len to 0), so steady-state frames never realloc.
+ * Exits on allocation failure after attempting cleanup. */
+void terminal_buffer_reserve(struct abuf *ab, int need);
+
 /* Free screen buffer memory. */
 void terminal_buffer_free(struct abuf *ab);
 
+/* Smallest allocation of a screen buffer */
+#define TERM_ABUF_MIN_CAP 4096
+
+/* ======================= Frame Output ===================================== */
+
+/* Synchronized output (DEC private mode 2026): the terminal holds a frame
+ * wrapped in these until it is complete, so it is never drawn half done. */
+#define TERM_SYNC_BEGIN "\x1b[?2026h"
+#define TERM_SYNC_END   "\x1b[?2026l"
+
+/* Synchronized output setting (:set sync=on|off|auto) */
+enum {
+    TERM_SYNC_OFF = 0,
+    TERM_SYNC_ON,
+    TERM_SYNC_AUTO      /* Use it if the terminal reported support */
+};
+
+void terminal_set_sync_mode(int mode);
+int terminal_get_sync_mode(void);
+
+/* Should frames be wrapped in TERM_SYNC_BEGIN/TERM_SYNC_END? */
+int terminal_sync_enabled(void);
+
+/* Append TERM_SYNC_BEGIN/TERM_SYNC_END if synchronized output is on. */
+void terminal_sync_begin(struct abuf *ab);
+void terminal_sync_end(struct abuf *ab);
+
+/* Write all of 'buf', retrying on EINTR and waiting for the descriptor on
+ * EAGAIN. Returns 0 on success, -1 on error. */
+int terminal_write_all(int fd, const char *buf, size_t len);
+
+/* Query the terminal (in raw mode) for synchronized output support.
+ * Returns 1 if supported, 0 if not or if the terminal did not answer. */
+int terminal_probe_sync_output(int ifd, int ofd);
+
 /* ======================= Signal Handling ================================== */
 
 /* Signal handler for SIGWINCH (window size change).
@@ -86,6 +195,7 @@ typedef struct TerminalHost {
     volatile sig_atomic_t winsize_changed; /* Set by SIGWINCH, cleared by app */
     int rawmode;                           /* Is raw mode currently active? */
     int fd;                                /* Terminal file descriptor */
+    int sync_output;                       /* Terminal supports mode 2026 */
 } TerminalHost;
 
 /* Global terminal host pointer (for signal handler access) */
@@ -0,0 +1,296 @@
+/* timer_wheel.c - Hierarchical timer wheel and the editor's timer service
+ *
+ * See timer_wheel.h for an overview. A slot of level L holding timers
+ * moves them down when the wheel reaches the tick its index names with
+ * the L * 6 low bits clear; the wheel only ever steps to the next such
+ * tick of an occupied slot, so empty stretches cost nothing.
+ */
+
+#include "timer_wheel.h"
+#include "async_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define ID_INDEX_BITS 20
+#define ID_INDEX_MASK ((1 << ID_INDEX_BITS) - 1)
+#define ID_GEN_MASK 0x7FF
+#define MAX_ENTRIES (ID_INDEX_MASK - 1)
+
+static int make_id(const TimerWheel *wheel, int32_t i) {
+    return (int)(((uint32_t)wheel->entries[i].gen & ID_GEN_MASK) << ID_INDEX_BITS) |
+           (i + 1);
+}
+
+/* Entry of an id that is armed, or -1 */
+static int32_t find_id(const TimerWheel *wheel, int id) {
+    if (id <= 0) return -1;
+    int32_t i = (id & ID_INDEX_MASK) - 1;
+    if (i < 0 || i >= wheel->nentries) return -1;
+    const TimerEntry *e = &wheel->entries[i];
+    if (!e->armed || (e->gen & ID_GEN_MASK) != (uint32_t)id >> ID_INDEX_BITS) return -1;
+    return i;
+}
+
+static void unlink_entry(TimerWheel *wheel, int32_t i) {
+    TimerEntry *e = &wheel->entries[i];
+    if (e->prev >= 0) wheel->entries[e->prev].next = e->next;
+    else wheel->heads[e->level][e->slot] = e->next;
+    if (e->next >= 0) wheel->entries[e->next].prev = e->prev;
+    if (wheel->heads[e->level][e->slot] < 0)
+        wheel->occupied[e->level] &= ~(1ull << e->slot);
+    e->armed = 0;
+    wheel->active--;
+}
+
+/* Put an armed entry, due at or after the wheel's tick, in its slot */
+static void place(TimerWheel *wheel, int32_t i) {
+    TimerEntry *e = &wheel->entries[i];
+    uint64_t delta = e->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    unsigned slot;
+    if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+        /* Past the top level's reach: the slot it comes to last, to be
+         * placed again from there */
+        slot = (unsigned)((wheel->now >> (TIMER_WHEEL_BITS * level)) + SLOT_MASK) & SLOT_MASK;
+    } else {
+        slot = (unsigned)(e->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    }
+
+    e->level = (uint8_t)level;
+    e->slot = (uint8_t)slot;
+    e->prev = -1;
+    e->next = wheel->heads[level][slot];
+    if (e->next >= 0) wheel->entries[e->next].prev = i;
+    wheel->heads[level][slot] = i;
+    wheel->occupied[level] |= 1ull << slot;
+    e->armed = 1;
+    wheel->active++;
+}
+
+static void free_entry(TimerWheel *wheel, int32_t i) {
+    TimerEntry *e = &wheel->entries[i];
+    e->gen++;
+    e->userdata = NULL;
+    e->next = wheel->free_head;
+    wheel->free_head = i;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    memset(wheel->heads, 0xFF, sizeof(wheel->heads));     /* All -1 */
+    wheel->now = now_ms;
+    wheel->free_head = -1;
+}
+
+void timer_wheel_free(TimerWheel *wheel) {
+    uint64_t now = wheel->now;
+    free(wheel->entries);
+    timer_wheel_init(wheel, now);
+}
+
+int timer_wheel_add(TimerWheel *wheel, uint64_t now_ms, uint64_t delay_ms,
+                    uint64_t interval_ms, void *userdata) {
+    int32_t i = wheel->free_head;
+    if (i >= 0) {
+        wheel->free_head = wheel->entries[i].next;
+    } else {
+        if (wheel->nentries >= MAX_ENTRIES) return -1;
+        if (wheel->nentries == wheel->capacity) {
+            int32_t cap = wheel->capacity ? wheel->capacity * 2 : 64;
+            TimerEntry *entries = realloc(wheel->entries, sizeof(TimerEntry) * (size_t)cap);
+            if (!entries) {
+                perror("Out of memory");
+                exit(1);
+            }
+            wheel->entries = entries;
+            wheel->capacity = cap;
+        }
+        i = wheel->nentries++;
+        wheel->entries[i].gen = 0;
+    }
+
+    /* The wheel may be behind the caller's clock; the earliest a timer
+     * can go is the next tick */
+    TimerEntry *e = &wheel->entries[i];
+    e->expires = (now_ms > wheel->now ? now_ms : wheel->now) + delay_ms;
+    if (e->expires <= wheel->now) e->expires = wheel->now + 1;
+    e->interval = interval_ms;
+    e->userdata = userdata;
+    place(wheel, i);
+    return make_id(wheel, i);
+}
+
+int timer_wheel_cancel(TimerWheel *wheel, int id) {
+    int32_t i = find_id(wheel, id);
+    if (i < 0) return -1;
+    unlink_entry(wheel, i);
+    free_entry(wheel, i);
+    return 0;
+}
+
+int timer_wheel_pending(const TimerWheel *wheel, int id) {
+    return find_id(wheel, id) >= 0;
+}
+
+/* The tick of the next occupied slot of any level, after the wheel's */
+static uint64_t next_tick(const TimerWheel *wheel) {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (!bits) continue;
+        int shift = TIMER_WHEEL_BITS * level;
+        unsigned from = (unsigned)((wheel->now >> shift) + 1) & SLOT_MASK;
+        /* Rotate so 'from' is bit 0; slots up to and including the
+         * current one come round last */
+        uint64_t ahead = from ? (bits >> from) | (bits << (TIMER_WHEEL_SLOTS - from)) : bits;
+        unsigned rel = 1;
+        while (!(ahead & 1)) {
+            ahead >>= 1;
+            rel++;
+        }
+        uint64_t tick = ((wheel->now >> shift) + rel) << shift;
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+int timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, TimerFireFn fire,
+                        void *arg) {
+    int fired = 0;
+    while (wheel->now < now_ms) {
+        uint64_t t = wheel->active ? next_tick(wheel) : UINT64_MAX;
+        if (t > now_ms) {
+            wheel->now = now_ms;
+            break;
+        }
+        wheel->now = t;
+
+        /* Move timers down, from the top, where the tick starts a slot */
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = TIMER_WHEEL_BITS * level;
+            if (t & ((1ull << shift) - 1)) continue;
+            unsigned slot = (unsigned)(t >> shift) & SLOT_MASK;
+            int32_t i;
+            while ((i = wheel->heads[level][slot]) >= 0) {
+                unlink_entry(wheel, i);
+                place(wheel, i);
+            }
+        }
+
+        /* Fire what is due. 'fire' may add and cancel timers, so take
+         * them off one at a time. */
+        unsigned slot = (unsigned)t & SLOT_MASK;
+        int32_t i;
+        while ((i = wheel->heads[0][slot]) >= 0) {
+            unlink_entry(wheel, i);
+            TimerEntry *e = &wheel->entries[i];
+            int id = make_id(wheel, i);
+            void *userdata = e->userdata;
+            if (e->interval) {
+                e->expires = t + e->interval;
+                place(wheel, i);
+                fire(id, userdata, arg);
+                fired++;
+            } else if (fire(id, userdata, arg) != 0) {
+                e = &wheel->entries[i];
+                e->expires = t + 1;
+                place(wheel, i);
+            } else {
+                free_entry(wheel, i);
+                fired++;
+            }
+        }
+    }
+    return fired;
+}
+
+int64_t timer_wheel_timeout(const TimerWheel *wheel, uint64_t now_ms) {
+    if (!wheel->active) return -1;
+    uint64_t t = next_tick(wheel);
+    return t > now_ms ? (int64_t)(t - now_ms) : 0;
+}
+
+/* ============================================================================
+ * Timer Service
+ * ============================================================================ */
+
+static struct {
+    int started;
+    TimerWheel wheel;
+    uv_timer_t handle;
+} service;
+
+static uint64_t service_now(void) {
+    return uv_hrtime() / 1000000;
+}
+
+/* Deliver a fire as an event; refused ones are tried again next tick */
+static int service_fire(int id, void *userdata, void *arg) {
+    (void)arg;
+    return async_queue_push_timer(NULL, id, userdata) == 0 ? 0 : -1;
+}
+
+static void on_service_timer(uv_timer_t *handle) {
+    (void)handle;
+    timer_service_run();
+}
+
+static int service_start(void) {
+    if (service.started) return 0;
+    if (!async_queue_global()) return -1;
+    if (uv_timer_init(uv_default_loop(), &service.handle) != 0) return -1;
+    timer_wheel_init(&service.wheel, service_now());
+    service.started = 1;
+    return 0;
+}
+
+/* Have the libuv loop wake for the next timer */
+static void service_arm(void) {
+    int64_t timeout = timer_wheel_timeout(&service.wheel, service_now());
+    if (timeout < 0) uv_timer_stop(&service.handle);
+    else uv_timer_start(&service.handle, on_service_timer, (uint64_t)timeout, 0);
+}
+
+int timer_service_add(uint64_t delay_ms, uint64_t interval_ms, void *userdata) {
+    if (service_start() != 0) return -1;
+    int id = timer_wheel_add(&service.wheel, service_now(), delay_ms, interval_ms, userdata);
+    if (id > 0) service_arm();
+    return id;
+}
+
+int timer_service_cancel(int id) {
+    if (!service.started) return -1;
+    return timer_wheel_cancel(&service.wheel, id);
+}
+
+int timer_service_pending(int id) {
+    return service.started && timer_wheel_pending(&service.wheel, id);
+}
+
+void timer_service_run(void) {
+    if (!service.started) return;
+    timer_wheel_advance(&service.wheel, service_now(), service_fire, NULL);
+    service_arm();
+}
+
+int timer_service_timeout(void) {
+    if (!service.started) return -1;
+    int64_t timeout = timer_wheel_timeout(&service.wheel, service_now());
+    return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+void timer_service_cleanup(void) {
+    if (!service.started) return;
+    uv_timer_stop(&service.handle);
+    uv_close((uv_handle_t *)&service.handle, NULL);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);  /* Run the close callback */
+    timer_wheel_free(&service.wheel);
+    service.started = 0;
+}
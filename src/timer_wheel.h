@@ -0,0 +1,103 @@
+/* timer_wheel.h - Hierarchical timer wheel and the editor's timer service
+ *
+ * A TimerWheel keeps timers in four levels of 64 slots, each slot of a
+ * level spanning 64 times the ticks of one below (1 ms ticks: 64 ms,
+ * 4 s, 4.4 min, 4.7 h). A timer goes in the slot of the lowest level
+ * whose reach covers it, and moves down a level when the wheel comes
+ * round to its slot, so adding and cancelling are O(1) and advancing
+ * costs a step per occupied slot or lap, however many timers there are.
+ * A bitmap per level says which slots hold timers, so the time to the
+ * next one is found without looking at any.
+ *
+ * Times are milliseconds, passed in so the wheel can be driven by a fake
+ * clock. Timer ids carry a generation: an id cancelled or fired stays
+ * dead after its entry is reused.
+ *
+ * The timer service is one TimerWheel for the editor, driven by a
+ * uv_timer_t on the libuv loop the async queue uses. A timer firing
+ * pushes an ASYNC_EVENT_TIMER event (timer_id, userdata), so handlers run
+ * on the main thread in the dispatch, like every other event. The
+ * service needs the async queue.
+ */
+
+#ifndef LOKI_TIMER_WHEEL_H
+#define LOKI_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+typedef struct TimerEntry {
+    uint64_t expires;               /* Tick it fires at */
+    uint64_t interval;              /* Ticks between fires, 0 once */
+    void *userdata;
+    int32_t prev, next;             /* In its slot, or the free list */
+    uint16_t gen;                   /* Bumped when the entry is freed */
+    uint8_t level, slot;
+    uint8_t armed;                  /* In a slot */
+} TimerEntry;
+
+typedef struct TimerWheel {
+    uint64_t now;                   /* Tick the wheel has reached */
+    int32_t heads[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];   /* -1: empty */
+    uint64_t occupied[TIMER_WHEEL_LEVELS];                  /* Bit per slot */
+    TimerEntry *entries;
+    int32_t nentries, capacity;
+    int32_t free_head;
+    int active;                     /* Timers armed */
+} TimerWheel;
+
+/* Called for a timer that fired at 'now'. Returns 0, or -1 if it could
+ * not be delivered: a one-shot timer then fires again next tick. */
+typedef int (*TimerFireFn)(int id, void *userdata, void *arg);
+
+/* Start an empty wheel at 'now_ms'. */
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+
+/* Free the wheel's entries; it is empty and can be used again. */
+void timer_wheel_free(TimerWheel *wheel);
+
+/* Arm a timer firing 'delay_ms' after 'now_ms', then every 'interval_ms'
+ * if that is not 0. Returns its id (> 0), or -1 with a million armed. */
+int timer_wheel_add(TimerWheel *wheel, uint64_t now_ms, uint64_t delay_ms,
+                    uint64_t interval_ms, void *userdata);
+
+/* Disarm a timer. Returns 0, or -1 if the id is not armed. */
+int timer_wheel_cancel(TimerWheel *wheel, int id);
+
+/* 1 if the timer is armed (an interval timer stays armed when it fires). */
+int timer_wheel_pending(const TimerWheel *wheel, int id);
+
+/* Fire the timers due by 'now_ms', in order of their times, calling 'fire'
+ * for each. Returns how many fired. */
+int timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, TimerFireFn fire,
+                        void *arg);
+
+/* Milliseconds from 'now_ms' until the wheel next has work (a timer or a
+ * slot moving down a level; 0 if due now), or -1 with no timers. */
+int64_t timer_wheel_timeout(const TimerWheel *wheel, uint64_t now_ms);
+
+/* Arm a service timer (see timer_wheel_add()). Returns its id, or -1
+ * without an async queue. */
+int timer_service_add(uint64_t delay_ms, uint64_t interval_ms, void *userdata);
+
+/* Disarm a service timer. Returns 0, or -1 if it is not armed. A fire
+ * already queued is still dispatched. */
+int timer_service_cancel(int id);
+
+/* 1 if a service timer is armed. */
+int timer_service_pending(int id);
+
+/* Fire the service timers due now and rearm the libuv timer. The main
+ * loop calls it each time round, for when it is not waiting on libuv. */
+void timer_service_run(void);
+
+/* Milliseconds until a service timer is due, or -1 with none. */
+int timer_service_timeout(void);
+
+/* Stop the service and drop its timers (before async_queue_cleanup()). */
+void timer_service_cleanup(void);
+
+#endif /* LOKI_TIMER_WHEEL_H */
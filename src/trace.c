@@ -0,0 +1,141 @@
+/* trace.c - Keystroke-to-screen latency tracing
+ *
+ * See trace.h for an overview.
+ */
+
+#include "trace.h"
+#include "perfhud.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+/* Events are gathered here and written whole, so a trace cut short by a
+ * crash ends between two events, never inside one */
+#define TRACE_BUF_SIZE 65536
+
+/* Longest event written */
+#define TRACE_EVENT_MAX 256
+
+static struct {
+    int fd;                 /* -1 when not tracing */
+    int pid;
+    int events;             /* Written, for the commas between them */
+    uint64_t next_input;    /* Id of the next input span */
+    uint64_t first_shown;   /* Inputs below it have ended */
+    int atexit_done;
+    size_t len;
+    char buf[TRACE_BUF_SIZE];
+} trace = { .fd = -1 };
+
+static void trace_flush(void) {
+    size_t at = 0;
+    while (at < trace.len) {
+        ssize_t n = write(trace.fd, trace.buf + at, trace.len - at);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;      /* The rest of the trace is lost */
+        at += (size_t)n;
+    }
+    trace.len = 0;
+}
+
+static void trace_printf(const char *fmt, ...) {
+    if (trace.len + TRACE_EVENT_MAX > sizeof(trace.buf)) trace_flush();
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(trace.buf + trace.len, sizeof(trace.buf) - trace.len, fmt, ap);
+    va_end(ap);
+    if (n > 0) trace.len += (size_t)n;
+}
+
+/* Start an event: everything up to the fields particular to it */
+static void event_head(const char *name, const char *ph, uint64_t ts_ns) {
+    trace_printf("%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":1,\"ts\":%.3f",
+                 trace.events++ ? ",\n" : "", name, ph, trace.pid, (double)ts_ns / 1e3);
+}
+
+static void trace_atexit(void) {
+    trace_stop();
+}
+
+int trace_start(const char *path) {
+    trace_stop();
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace.fd < 0) return -1;
+    trace.pid = (int)getpid();
+    trace.events = 0;
+    trace.next_input = trace.first_shown = 0;
+    trace.len = 0;
+    trace_printf("[\n");
+
+    event_head("process_name", "M", 0);
+    trace_printf(",\"args\":{\"name\":\"loki\"}}");
+    if (!trace.atexit_done) {
+        atexit(trace_atexit);
+        trace.atexit_done = 1;
+    }
+    return 0;
+}
+
+void trace_start_from_env(void) {
+    const char *path = getenv(TRACE_ENV);
+    if (trace.fd >= 0 || !path || !*path) return;
+    if (trace_start(path) != 0)
+        fprintf(stderr, "Warning: " TRACE_ENV "=%s: %s\n", path, strerror(errno));
+}
+
+void trace_stop(void) {
+    if (trace.fd < 0) return;
+    trace_printf("\n]\n");
+    trace_flush();
+    close(trace.fd);
+    trace.fd = -1;
+}
+
+int trace_active(void) {
+    return trace.fd >= 0;
+}
+
+uint64_t trace_begin(void) {
+    return trace.fd >= 0 || perfhud_enabled() ? uv_hrtime() : 0;
+}
+
+void trace_end(const char *name, uint64_t start) {
+    if (!start) return;
+    uint64_t dur = uv_hrtime() - start;
+    perfhud_span(name, dur);
+    if (trace.fd < 0) return;
+    event_head(name, "X", start);
+    trace_printf(",\"dur\":%.3f}", (double)dur / 1e3);
+}
+
+void trace_input(const EditorEvent *ev, uint64_t read_ns) {
+    if (trace.fd < 0) return;
+    event_head("input", "b", read_ns);
+    if (ev->type == EVENT_PASTE)
+        trace_printf(",\"cat\":\"latency\",\"id\":%llu,\"args\":{\"paste\":%zu}}",
+                     (unsigned long long)trace.next_input++, ev->data.paste.len);
+    else if (ev->type == EVENT_MOUSE)
+        trace_printf(",\"cat\":\"latency\",\"id\":%llu,\"args\":{\"mouse\":%d,\"wheel\":%d}}",
+                     (unsigned long long)trace.next_input++,
+                     ev->data.mouse.kind, ev->data.mouse.wheel);
+    else
+        trace_printf(",\"cat\":\"latency\",\"id\":%llu,\"args\":{\"key\":%d,\"repeat\":%d}}",
+                     (unsigned long long)trace.next_input++,
+                     event_to_keycode(ev), event_repeat(ev));
+}
+
+void trace_frame_shown(void) {
+    if (trace.fd < 0) return;
+    uint64_t now = uv_hrtime();
+    for (; trace.first_shown < trace.next_input; trace.first_shown++) {
+        event_head("input", "e", now);
+        trace_printf(",\"cat\":\"latency\",\"id\":%llu}",
+                     (unsigned long long)trace.first_shown);
+    }
+    trace_flush();
+}
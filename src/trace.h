@@ -0,0 +1,60 @@
+/* trace.h - Keystroke-to-screen latency tracing (LOKI_TRACE=path)
+ *
+ * With LOKI_TRACE set to a path when the editor starts, each key is
+ * timestamped as it is read and followed to the frame that shows it,
+ * and the work in between is timed on the way:
+ *
+ *   - "input": an async span per event read (event_read_terminal()),
+ *     from the read until the frame flush that first shows it; its
+ *     length is the keystroke-to-screen latency
+ *   - "modal_process_event": handling the event
+ *   - "syntax": syntax_fresh_rows() bringing the visible rows up to date
+ *   - "rows": building the frame, row segments and escapes
+ *   - "segments": building a session's view model (EditorViewModel)
+ *   - "flush": writing the frame to the terminal
+ *
+ * The trace is written in the Chrome trace event format (a JSON array of
+ * events, microsecond timestamps), as chrome://tracing and Perfetto read
+ * it. Events are written whole, after every frame, so a trace of a hang
+ * or a crash is cut between two events and keeps all but the frame in
+ * progress. The spans also feed the performance HUD (perfhud.h), and are
+ * timed while it is on without a trace. Off, every call is a test of one
+ * or two integers.
+ */
+
+#ifndef LOKI_TRACE_H
+#define LOKI_TRACE_H
+
+#include <stdint.h>
+#include "event.h"
+
+/* Environment variable naming the trace file */
+#define TRACE_ENV "LOKI_TRACE"
+
+/* Start tracing to 'path', replaced if it exists, until trace_stop() or
+ * exit. Returns 0, or -1 with errno set. */
+int trace_start(const char *path);
+
+/* trace_start() the file named by LOKI_TRACE, if it is set and tracing
+ * is not on already. A file that cannot be opened is reported to stderr. */
+void trace_start_from_env(void);
+
+/* End the trace and close its file. */
+void trace_stop(void);
+
+/* Is a trace being written? */
+int trace_active(void);
+
+/* The start of a span: now, or 0 when neither tracing nor showing the HUD */
+uint64_t trace_begin(void);
+
+/* End the span named 'name' begun at 'start' (from trace_begin()) */
+void trace_end(const char *name, uint64_t start);
+
+/* An event read at 'read_ns' (uv_hrtime()), waiting to be shown */
+void trace_input(const EditorEvent *ev, uint64_t read_ns);
+
+/* A frame just reached the terminal: the inputs read before it are shown */
+void trace_frame_shown(void);
+
+#endif /* LOKI_TRACE_H */
@@ -6,14 +6,46 @@
  * supporting Lua, Python, Scheme, Haskell, and Markdown.
  */
 
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
 #include "treesitter.h"
 
 #ifdef LOKI_USE_LINENOISE
 
 #include "internal.h"
+#include "task_pool.h"
+#include "startup.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <uv.h>
+
+/* A background parse running longer than this is abandoned */
+#define TS_PARSE_TIMEOUT_NS (5ULL * 1000000000ULL)
+
+/* One background parse of a snapshot of the document. Jobs are linked in
+ * a main-thread-only list so a late event can tell whether its job is
+ * still around; the worker only touches the job's own fields. */
+typedef struct TsParseJob {
+    int id;
+    TreeSitterState *ts;
+    EditorModel *model;       /* Rows to mark stale when the tree lands */
+    TSTree *old;              /* Copy of the edited tree, or NULL */
+    char *text;               /* Snapshot of the document */
+    uint32_t len;
+    uint64_t gen;             /* ts->edit_gen at the snapshot */
+    uint64_t deadline;        /* uv_hrtime() after which the parse gives up */
+    atomic_int cancel;
+    atomic_int joining;       /* finish_parse_job() waits: no event needed */
+    TSTree *result;           /* NULL if cancelled or timed out */
+    Task *task;
+    struct TsParseJob *next;
+} TsParseJob;
+
+static TsParseJob *parse_jobs = NULL;
+static int parse_next_id = 1;
 
 /* External tree-sitter language functions */
 extern const TSLanguage *tree_sitter_lua(void);
@@ -94,6 +126,121 @@ static const char *MARKDOWN_HIGHLIGHT_QUERY =
     "(link_destination) @number\n"
 ;
 
+/* Tag queries for each language, one pattern per string (see
+ * pattern_query()) */
+static const char *LUA_TAGS_PATTERNS[] = {
+    "(function_declaration name: (identifier) @name) @definition.function",
+    "(function_declaration name: (dot_index_expression"
+    " field: (identifier) @name)) @definition.function",
+    "(function_declaration name: (method_index_expression"
+    " method: (identifier) @name)) @definition.function",
+    "(assignment_statement (variable_list . name: (identifier) @name)"
+    " (expression_list . value: (function_definition))) @definition.function",
+    NULL
+};
+
+static const char *PYTHON_TAGS_PATTERNS[] = {
+    "(function_definition name: (identifier) @name) @definition.function",
+    "(class_definition name: (identifier) @name) @definition.type",
+    NULL
+};
+
+static const char *SCHEME_TAGS_PATTERNS[] = {
+    "(list . \"define\" . (symbol) @name) @definition.function",
+    "(list . \"define\" . (list . (symbol) @name)) @definition.function",
+    "(list . \"define-syntax\" . (symbol) @name) @definition.function",
+    "(list . (symbol) @_kw . (symbol) @name"
+    " (#any-of? @_kw \"define\" \"define-syntax\")) @definition.function",
+    "(list . (symbol) @_kw . (list . (symbol) @name)"
+    " (#eq? @_kw \"define\")) @definition.function",
+    "(list . (symbol) @_kw . (symbol) @name"
+    " (#eq? @_kw \"define-record-type\")) @definition.type",
+    NULL
+};
+
+static const char *HASKELL_TAGS_PATTERNS[] = {
+    "(signature name: (variable) @name) @definition.function",
+    "(function name: (variable) @name) @definition.function",
+    "(adt (type) @name) @definition.type",
+    "(newtype (type) @name) @definition.type",
+    "(data_type name: (name) @name) @definition.type",
+    "(newtype name: (name) @name) @definition.type",
+    "(class name: (name) @name) @definition.type",
+    NULL
+};
+
+static const char *MARKDOWN_TAGS_PATTERNS[] = {
+    "(atx_heading (inline) @name) @definition.heading",
+    "(setext_heading (paragraph (inline) @name)) @definition.heading",
+    NULL
+};
+
+/* Indent queries, in patterns like the tags. The lines of an @indent node
+ * after its first go one level deeper than that first line; a line
+ * starting with a @branch node (a closing bracket, "end", "else:") goes
+ * at the level of the @indent node around it. Haskell's layout and
+ * Markdown have none: their lines keep to the bracket rules. */
+static const char *LUA_INDENT_PATTERNS[] = {
+    "[(function_declaration) (function_definition) (if_statement)"
+    " (elseif_statement) (else_statement) (for_statement) (while_statement)"
+    " (repeat_statement) (do_statement) (table_constructor) (arguments)"
+    " (parameters) (parenthesized_expression)] @indent",
+    "[(elseif_statement) (else_statement) \"end\" \"until\" \"}\" \")\" \"]\"] @branch",
+    NULL
+};
+
+static const char *PYTHON_INDENT_PATTERNS[] = {
+    "[(function_definition) (class_definition) (if_statement) (elif_clause)"
+    " (else_clause) (for_statement) (while_statement) (with_statement)"
+    " (try_statement) (except_clause) (finally_clause) (list) (dictionary)"
+    " (set) (tuple) (argument_list) (parameters) (parenthesized_expression)"
+    " (list_comprehension) (dictionary_comprehension) (set_comprehension)"
+    " (generator_expression)] @indent",
+    "[(match_statement) (case_clause)] @indent",
+    "[(elif_clause) (else_clause) (except_clause) (finally_clause)"
+    " \"}\" \")\" \"]\"] @branch",
+    "(case_clause) @branch",
+    NULL
+};
+
+static const char *SCHEME_INDENT_PATTERNS[] = {
+    "[(list) (vector)] @indent",
+    "\")\" @branch",
+    "\"]\" @branch",
+    NULL
+};
+
+/* Fold queries: the @fold nodes spanning rows fold. A language without
+ * one folds every named node that does. */
+static const char *LUA_FOLD_PATTERNS[] = {
+    "[(function_declaration) (function_definition) (if_statement)"
+    " (elseif_statement) (else_statement) (for_statement) (while_statement)"
+    " (repeat_statement) (do_statement) (table_constructor)] @fold",
+    "(comment) @fold",
+    NULL
+};
+
+static const char *PYTHON_FOLD_PATTERNS[] = {
+    "[(function_definition) (class_definition) (decorated_definition)"
+    " (if_statement) (elif_clause) (else_clause) (for_statement)"
+    " (while_statement) (with_statement) (try_statement) (except_clause)"
+    " (finally_clause) (list) (dictionary) (set) (tuple) (argument_list)"
+    " (parameters) (import_from_statement) (string)] @fold",
+    "[(match_statement) (case_clause)] @fold",
+    NULL
+};
+
+static const char *SCHEME_FOLD_PATTERNS[] = {
+    "[(list) (vector) (block_comment)] @fold",
+    NULL
+};
+
+static const char *MARKDOWN_FOLD_PATTERNS[] = {
+    "[(section) (fenced_code_block) (list) (block_quote) (pipe_table)"
+    " (html_block)] @fold",
+    NULL
+};
+
 /**
  * Map capture name to HL_* constant.
  */
@@ -186,6 +333,196 @@ static const char *get_highlight_query(const char *lang_name) {
     return NULL;
 }
 
+/* ======================== Shared queries and pools ======================== */
+
+/* Parsers and query cursors kept for reuse, of each */
+#define TS_POOL_MAX 16
+
+/* Compiled highlight queries, by language, built on first use and shared
+ * by every buffer of the language: never freed. */
+typedef struct TsHighlightQuery {
+    const char *lang;
+    TSQuery *query;         /* NULL if it did not compile */
+    int tried;
+} TsHighlightQuery;
+
+static TsHighlightQuery highlight_queries[] = {
+    {"lua", NULL, 0},
+    {"python", NULL, 0},
+    {"scheme", NULL, 0},
+    {"haskell", NULL, 0},
+    {"markdown", NULL, 0},
+};
+
+/* Parsers and cursors given back by buffers closed and parses done.
+ * Parsers keep their last language, so a buffer of the same language
+ * needs no setting up. */
+static TSParser *parser_pool[TS_POOL_MAX];
+static int parsers_pooled;
+static TSQueryCursor *cursor_pool[TS_POOL_MAX];
+static int cursors_pooled;
+
+/* Guards the queries being built and the pools: tags are read on the
+ * task pool */
+static uv_once_t shared_once = UV_ONCE_INIT;
+static uv_mutex_t shared_lock;
+
+static void shared_lock_init(void) {
+    if (uv_mutex_init(&shared_lock) != 0) {
+        perror("Out of memory");
+        exit(1);
+    }
+}
+
+/* The entry of the language's highlight query, or NULL if it has none */
+static TsHighlightQuery *highlight_entry(const char *lang_name) {
+    if (get_highlight_query(lang_name) == NULL) return NULL;
+    for (size_t i = 0; i < sizeof(highlight_queries) / sizeof(highlight_queries[0]); i++)
+        if (strcmp(highlight_queries[i].lang, lang_name) == 0) return &highlight_queries[i];
+    return NULL;
+}
+
+/* The language's highlight query, compiled once, on first use */
+static TSQuery *highlight_query(const char *lang_name, const TSLanguage *language) {
+    TsHighlightQuery *hq = highlight_entry(lang_name);
+    if (hq == NULL) return NULL;
+
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    if (!hq->tried) {
+        hq->tried = 1;
+        const char *source = get_highlight_query(lang_name);
+        uint32_t error_offset;
+        TSQueryError error_type;
+        uint64_t start = uv_hrtime();
+        hq->query = ts_query_new(language, source, (uint32_t)strlen(source),
+                                 &error_offset, &error_type);
+        startup_note_deferred("tree-sitter query", start);
+    }
+    uv_mutex_unlock(&shared_lock);
+    return hq->query;
+}
+
+/* A parser for 'language': a pooled one, of the language if there is one,
+ * or a new one. NULL if none can be made. */
+static TSParser *take_parser(const TSLanguage *language) {
+    TSParser *parser = NULL;
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    for (int i = parsers_pooled - 1; i >= 0; i--) {
+        if (ts_parser_language(parser_pool[i]) == language) {
+            parser = parser_pool[i];
+            parser_pool[i] = parser_pool[--parsers_pooled];
+            break;
+        }
+    }
+    if (parser == NULL && parsers_pooled > 0)
+        parser = parser_pool[--parsers_pooled];
+    uv_mutex_unlock(&shared_lock);
+
+    if (parser == NULL) parser = ts_parser_new();
+    if (parser == NULL) return NULL;
+    if (ts_parser_language(parser) != language &&
+        !ts_parser_set_language(parser, language)) {
+        ts_parser_delete(parser);
+        return NULL;
+    }
+    return parser;
+}
+
+/* Give a parser back to the pool, or delete it if the pool is full */
+static void give_parser(TSParser *parser) {
+    if (parser == NULL) return;
+    ts_parser_reset(parser);
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    if (parsers_pooled < TS_POOL_MAX) {
+        parser_pool[parsers_pooled++] = parser;
+        parser = NULL;
+    }
+    uv_mutex_unlock(&shared_lock);
+    if (parser) ts_parser_delete(parser);
+}
+
+static TSQueryCursor *take_cursor(void) {
+    TSQueryCursor *cursor = NULL;
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    if (cursors_pooled > 0) cursor = cursor_pool[--cursors_pooled];
+    uv_mutex_unlock(&shared_lock);
+    return cursor ? cursor : ts_query_cursor_new();
+}
+
+/* Give a cursor back to the pool, or delete it if the pool is full. The
+ * next exec resets what it was last run with, but not its ranges. */
+static void give_cursor(TSQueryCursor *cursor) {
+    if (cursor == NULL) return;
+    TSPoint end = {UINT32_MAX, UINT32_MAX};
+    ts_query_cursor_set_byte_range(cursor, 0, UINT32_MAX);
+    ts_query_cursor_set_point_range(cursor, (TSPoint){0, 0}, end);
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    if (cursors_pooled < TS_POOL_MAX) {
+        cursor_pool[cursors_pooled++] = cursor;
+        cursor = NULL;
+    }
+    uv_mutex_unlock(&shared_lock);
+    if (cursor) ts_query_cursor_delete(cursor);
+}
+
+/* Queries built from one pattern per string, by language, compiled on
+ * first use and never freed. Grammar versions name their nodes
+ * differently: a pattern that does not compile is left out, so the rest
+ * still work. Tables end with a NULL language. */
+typedef struct TsPatternQuery {
+    const char *lang;
+    const char **patterns;
+    TSQuery *query;         /* NULL if no pattern compiled */
+    int tried;
+} TsPatternQuery;
+
+/* The language's query in 'table', from the patterns that compile. */
+static TSQuery *pattern_query(TsPatternQuery *table, const char *lang_name,
+                              const TSLanguage *language) {
+    TsPatternQuery *tq = NULL;
+    for (int i = 0; lang_name && table[i].lang; i++)
+        if (strcmp(table[i].lang, lang_name) == 0) tq = &table[i];
+    if (tq == NULL) return NULL;
+
+    uv_once(&shared_once, shared_lock_init);
+    uv_mutex_lock(&shared_lock);
+    if (!tq->tried) {
+        tq->tried = 1;
+        size_t size = 1;
+        for (int i = 0; tq->patterns[i]; i++) size += strlen(tq->patterns[i]) + 1;
+        char *source = malloc(size);
+        if (!source) {
+            perror("Out of memory");
+            exit(1);
+        }
+        size_t len = 0;
+        for (int i = 0; tq->patterns[i]; i++) {
+            uint32_t error_offset;
+            TSQueryError error_type;
+            const char *p = tq->patterns[i];
+            TSQuery *one = ts_query_new(language, p, (uint32_t)strlen(p),
+                                        &error_offset, &error_type);
+            if (!one) continue;
+            ts_query_delete(one);
+            len += (size_t)sprintf(source + len, "%s\n", p);
+        }
+        if (len > 0) {
+            uint32_t error_offset;
+            TSQueryError error_type;
+            tq->query = ts_query_new(language, source, (uint32_t)len,
+                                     &error_offset, &error_type);
+        }
+        free(source);
+    }
+    uv_mutex_unlock(&shared_lock);
+    return tq->query;
+}
+
 const char *treesitter_lang_from_filename(const char *filename) {
     if (!filename) return NULL;
 
@@ -204,16 +541,15 @@ const char *treesitter_lang_from_filename(const char *filename) {
 }
 
 TreeSitterState *treesitter_init(const char *lang_name) {
-    uint32_t error_offset;
-    TSQueryError error_type;
-
     const TSLanguage *language = treesitter_get_language(lang_name);
     if (!language) {
         return NULL;
     }
 
-    const char *query_str = get_highlight_query(lang_name);
-    if (!query_str) {
+    /* The query is compiled by the first highlighting, once for the
+     * language, and shared */
+    TsHighlightQuery *hq = highlight_entry(lang_name);
+    if (!hq) {
         return NULL;
     }
 
@@ -223,39 +559,18 @@ TreeSitterState *treesitter_init(const char *lang_name) {
     }
 
     ts->language = language;
+    ts->lang_name = hq->lang;
+    ts->byte_row = -1;
 
-    /* Create parser */
-    ts->parser = ts_parser_new();
+    ts->parser = take_parser(language);
     if (!ts->parser) {
         free(ts);
         return NULL;
     }
 
-    if (!ts_parser_set_language(ts->parser, language)) {
-        ts_parser_delete(ts->parser);
-        free(ts);
-        return NULL;
-    }
-
-    /* Create query */
-    ts->query = ts_query_new(
-        language,
-        query_str,
-        (uint32_t)strlen(query_str),
-        &error_offset,
-        &error_type
-    );
-    if (!ts->query) {
-        ts_parser_delete(ts->parser);
-        free(ts);
-        return NULL;
-    }
-
-    /* Create cursor */
-    ts->cursor = ts_query_cursor_new();
+    ts->cursor = take_cursor();
     if (!ts->cursor) {
-        ts_query_delete(ts->query);
-        ts_parser_delete(ts->parser);
+        give_parser(ts->parser);
         free(ts);
         return NULL;
     }
@@ -263,102 +578,752 @@ TreeSitterState *treesitter_init(const char *lang_name) {
     return ts;
 }
 
+static void finish_parse_job(TsParseJob *job, int install);
+
 void treesitter_free(TreeSitterState *ts) {
     if (!ts) return;
 
-    if (ts->cursor) {
-        ts_query_cursor_delete(ts->cursor);
-    }
-    if (ts->query) {
-        ts_query_delete(ts->query);
+    if (ts->job) {
+        atomic_store(&ts->job->cancel, 1);
+        finish_parse_job(ts->job, 0);
     }
+    /* The query is the language's; the rest goes back to the pools */
+    give_parser(ts->bg_parser);
+    give_cursor(ts->cursor);
     if (ts->tree) {
         ts_tree_delete(ts->tree);
     }
-    if (ts->parser) {
-        ts_parser_delete(ts->parser);
-    }
-    if (ts->source) {
-        free(ts->source);
-    }
+    give_parser(ts->parser);
 
     free(ts);
 }
 
-void treesitter_reparse(TreeSitterState *ts, const char *source, size_t len) {
-    if (!ts || !ts->parser) return;
+/* TSInput read callback: tree-sitter tracks the row/column it wants. */
+static const char *read_model(void *payload, uint32_t byte_index,
+                              TSPoint position, uint32_t *bytes_read) {
+    (void)byte_index;
+    size_t len;
+    const char *data = editor_model_read_at(payload, (int)position.row,
+                                            (int)position.column,
+                                            EXPORT_NEWLINES, &len);
+    *bytes_read = (uint32_t)len;
+    return data;
+}
+
+/* Parse the model, reusing 'old' (already edited) if given. The result
+ * replaces ts->tree; 'old' is left to the caller. */
+static void treesitter_reparse_model_from(TreeSitterState *ts,
+                                          const EditorModel *model,
+                                          TSTree *old) {
+    TSInput input;
+    input.payload = (void *)model;
+    input.read = read_model;
+    input.encoding = TSInputEncodingUTF8;
+    input.decode = NULL;
+
+    TSTree *tree = ts_parser_parse(ts->parser, old, input);
+    if (ts->tree) {
+        ts_tree_delete(ts->tree);
+    }
+    ts->tree = tree;
+}
+
+void treesitter_reparse_model(TreeSitterState *ts, const EditorModel *model) {
+    if (!ts || !ts->parser || !model) return;
 
-    /* Store source for later use */
-    if (ts->source_cap < len + 1) {
-        char *new_source = realloc(ts->source, len + 1);
-        if (!new_source) return;
-        ts->source = new_source;
-        ts->source_cap = len + 1;
+    treesitter_reparse_model_from(ts, model, ts->tree);
+    ts->stale = 0;
+}
+
+/* Start byte of a row in the parsed text: the rows above it plus their
+ * newlines. The last answer is cached, so edits on one row stay O(1). */
+static uint32_t row_start_byte(TreeSitterState *ts, const EditorModel *model,
+                               int row) {
+    int r = 0;
+    uint32_t off = 0;
+
+    if (ts->byte_row >= 0 && ts->byte_row <= row) {
+        r = ts->byte_row;
+        off = ts->byte_off;
     }
-    memcpy(ts->source, source, len);
-    ts->source[len] = '\0';
-    ts->source_len = len;
+    for (; r < row && r < model->numrows; r++)
+        off += (uint32_t)model->row[r].size + 1;
+    ts->byte_row = row;
+    ts->byte_off = off;
+    return off;
+}
+
+void treesitter_note_edit(TreeSitterState *ts, const EditorModel *model,
+                          TSPoint start, TSPoint old_end, uint32_t old_len,
+                          TSPoint new_end, uint32_t new_len) {
+    if (!ts) return;
+
+    ts->stale = 1;
+    ts->edit_gen++;
+    if (ts->job) atomic_store(&ts->job->cancel, 1);  /* Parsing old text */
+    if (ts->approx_from < ts->approx_to && start.row < (uint32_t)ts->approx_to &&
+        new_end.row != old_end.row)
+        ts->approx_to++;  /* Widen over a row moving in or out */
+    /* Rows from here down may have moved; the rows above have not */
+    if (ts->byte_row > (int)start.row) ts->byte_row = -1;
+    if (!ts->tree) return;  /* The next sync parses from scratch anyway */
+
+    TSInputEdit edit;
+    edit.start_byte = row_start_byte(ts, model, (int)start.row) + start.column;
+    edit.old_end_byte = edit.start_byte + old_len;
+    edit.new_end_byte = edit.start_byte + new_len;
+    edit.start_point = start;
+    edit.old_end_point = old_end;
+    edit.new_end_point = new_end;
+    ts_tree_edit(ts->tree, &edit);
+}
+
+void treesitter_reset(TreeSitterState *ts) {
+    if (!ts) return;
 
-    /* Delete old tree if exists */
     if (ts->tree) {
         ts_tree_delete(ts->tree);
+        ts->tree = NULL;
+    }
+    ts->byte_row = -1;
+    ts->approx_from = ts->approx_to = 0;
+    ts->stale = 1;
+    ts->edit_gen++;
+    if (ts->job) atomic_store(&ts->job->cancel, 1);
+}
+
+/* Replace the tree with 'tree', a parse of the current text. Rows whose
+ * syntax changed, and rows highlighted from the outdated tree, are
+ * reported as [*from, *to). */
+static int install_tree(TreeSitterState *ts, int numrows, TSTree *tree,
+                        int *from, int *to) {
+    TSTree *old = ts->tree;
+    ts->tree = tree;
+    ts->stale = 0;
+
+    int changed = 0;
+    if (!old) {
+        /* Rows highlighted before the reset saw another tree (or none) */
+        *from = 0;
+        *to = numrows;
+        changed = tree != NULL;
+    } else {
+        uint32_t count = 0;
+        TSRange *ranges = tree ? ts_tree_get_changed_ranges(old, tree, &count)
+                               : NULL;
+        ts_tree_delete(old);
+        if (count > 0) {
+            *from = (int)ranges[0].start_point.row;
+            *to = (int)ranges[count - 1].end_point.row + 1;
+            changed = 1;
+        }
+        free(ranges);
     }
 
-    /* Parse the source */
-    ts->tree = ts_parser_parse_string(ts->parser, NULL, source, (uint32_t)len);
+    if (ts->approx_from < ts->approx_to) {
+        if (!changed || ts->approx_from < *from) *from = ts->approx_from;
+        if (!changed || ts->approx_to > *to) *to = ts->approx_to;
+        changed = 1;
+        ts->approx_from = ts->approx_to = 0;
+    }
+    if (*to > numrows) *to = numrows;
+    return changed && *from < *to;
+}
+
+/* TSInput read callback over a job's snapshot. */
+static const char *read_snapshot(void *payload, uint32_t byte_index,
+                                 TSPoint position, uint32_t *bytes_read) {
+    (void)position;
+    TsParseJob *job = payload;
+    if (byte_index >= job->len) {
+        *bytes_read = 0;
+        return "";
+    }
+    *bytes_read = job->len - byte_index;
+    return job->text + byte_index;
+}
+
+/* Progress callback: give up when a newer edit came in or time ran out. */
+static bool parse_should_stop(TSParseState *state) {
+    TsParseJob *job = state->payload;
+    return atomic_load(&job->cancel) || uv_hrtime() > job->deadline;
+}
+
+static void push_parse_event(TsParseJob *job) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = TS_PARSE_ASYNC_EVENT;
+    ev.data.user.i64[0] = job->id;
+
+    /* Completion must not be lost; wait for room in the queue, unless
+     * finish_parse_job() is waiting for us: then the main thread isn't
+     * draining it, and needs no event */
+    while (async_queue_push(NULL, &ev) != 0) {
+        if (atomic_load(&job->joining)) return;
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+    }
+}
+
+static void parse_worker(void *arg) {
+    TsParseJob *job = arg;
+    TSParser *parser = job->ts->bg_parser;
+
+    TSInput input;
+    input.payload = job;
+    input.read = read_snapshot;
+    input.encoding = TSInputEncodingUTF8;
+    input.decode = NULL;
+
+    TSParseOptions options;
+    options.payload = job;
+    options.progress_callback = parse_should_stop;
+
+    ts_parser_reset(parser);  /* Never resume a cancelled parse */
+    job->result = ts_parser_parse_with_options(parser, job->old, input, options);
+    /* Run by finish_parse_job() itself, on the thread draining the queue */
+    if (!atomic_load(&job->joining)) push_parse_event(job);
+}
+
+/* Main thread: wait for a job and forget it. With 'install', a result that
+ * still matches the text replaces the tree and marks rows stale. */
+static void finish_parse_job(TsParseJob *job, int install) {
+    atomic_store(&job->joining, 1);
+    task_wait(job->task);
+
+    TsParseJob **pp = &parse_jobs;
+    while (*pp != job) pp = &(*pp)->next;
+    *pp = job->next;
+
+    TreeSitterState *ts = job->ts;
+    ts->job = NULL;
+    if (install && job->result && job->gen == ts->edit_gen) {
+        EditorModel *model = job->model;
+        int from, to;
+        if (install_tree(ts, model->numrows, job->result, &from, &to)) {
+            for (int r = from; r < to; r++) {
+                model->row[r].hl_stale = 1;
+                editor_row_damage(model, &model->row[r]);
+            }
+            if (from < model->hl_stale_from) model->hl_stale_from = from;
+        }
+    } else if (job->result) {
+        ts_tree_delete(job->result);
+    }
+    if (job->old) ts_tree_delete(job->old);
+    free(job->text);
+    free(job);
+}
+
+static void parse_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    int id = (int)event->data.user.i64[0];
+    TsParseJob *job = parse_jobs;
+    while (job && job->id != id) job = job->next;
+    if (job) finish_parse_job(job, 1);
+}
+
+/* editor_model_export() callback: append a span to the snapshot. */
+static int snapshot_span(const char *data, size_t len, void *arg) {
+    TsParseJob *job = arg;
+    memcpy(job->text + job->len, data, len);
+    job->len += (uint32_t)len;
+    return 0;
+}
+
+/* Start parsing a snapshot of the model on the task pool. Returns -1 if
+ * the job could not be started (the caller parses synchronously). */
+static int start_parse_job(TreeSitterState *ts, EditorModel *model,
+                           size_t size) {
+    if (!ts->bg_parser) {
+        ts->bg_parser = take_parser(ts->language);
+        if (!ts->bg_parser) return -1;
+    }
+
+    TsParseJob *job = calloc(1, sizeof(*job));
+    if (job) job->text = malloc(size + 1);
+    if (!job || !job->text) {
+        free(job);
+        return -1;
+    }
+    editor_model_export(model, EXPORT_NEWLINES, snapshot_span, job);
+    job->id = parse_next_id++;
+    job->ts = ts;
+    job->model = model;
+    job->old = ts->tree ? ts_tree_copy(ts->tree) : NULL;
+    job->gen = ts->edit_gen;
+    job->deadline = uv_hrtime() + TS_PARSE_TIMEOUT_NS;
+    atomic_init(&job->cancel, 0);
+    atomic_init(&job->joining, 0);
+
+    if (async_queue_get_handler(NULL, TS_PARSE_ASYNC_EVENT) != parse_event_handler) {
+        async_queue_set_handler_lane(NULL, TS_PARSE_ASYNC_EVENT, parse_event_handler,
+                                     ASYNC_LANE_HIGH);
+        async_event_set_type_name(TS_PARSE_ASYNC_EVENT, "parse");
+    }
+
+    job->next = parse_jobs;
+    parse_jobs = job;
+    ts->job = job;
+    job->task = task_submit(parse_worker, job, TASK_PRIORITY_HIGH, NULL);
+    if (job->task == NULL) {
+        parse_jobs = job->next;
+        ts->job = NULL;
+        if (job->old) ts_tree_delete(job->old);
+        free(job->text);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+int treesitter_sync(TreeSitterState *ts, const EditorModel *model,
+                    int *from, int *to) {
+    if (!ts || !ts->parser || !model) return 0;
+    if (ts->tree && !ts->stale) return 0;
+
+    if (async_queue_global() != NULL) {
+        size_t size = editor_model_export_size(model, EXPORT_NEWLINES);
+        if (size >= TS_ASYNC_MIN_BYTES && size < UINT32_MAX) {
+            /* A job on older text was cancelled and will land shortly */
+            if (ts->job) return 0;
+            if (start_parse_job(ts, (EditorModel *)model, size) == 0) return 0;
+        }
+    }
+    return treesitter_sync_here(ts, model, from, to);
+}
+
+int treesitter_sync_here(TreeSitterState *ts, const EditorModel *model,
+                         int *from, int *to) {
+    if (!ts || !ts->parser || !model) return 0;
+    if (ts->tree && !ts->stale) return 0;
+    if (ts->job) {
+        /* The document shrank below the threshold, or the tree is wanted
+         * now: parse here instead */
+        atomic_store(&ts->job->cancel, 1);
+        finish_parse_job(ts->job, 0);
+    }
+
+    TSTree *old = ts->tree;
+    ts->tree = NULL;
+    treesitter_reparse_model_from(ts, model, old);
+    TSTree *tree = ts->tree;
+    ts->tree = old;
+    return install_tree(ts, model->numrows, tree, from, to);
 }
 
 void treesitter_edit(TreeSitterState *ts, TSInputEdit *edit) {
     if (!ts || !ts->tree || !edit) return;
 
     ts_tree_edit(ts->tree, edit);
+    ts->stale = 1;
 }
 
-void treesitter_update_row(editor_ctx_t *ctx, t_erow *row, TreeSitterState *ts) {
-    if (!ctx || !row || !ts || !ts->parser || !ts->query || !ts->cursor) {
-        return;
-    }
+/* Position in row->hl_buf.hl of the char at byte column 'col', clamped to the
+ * rendered part of the row (TABs expand; long rows render a window). */
+static int hl_col(t_erow *row, uint32_t col) {
+    int c = col > (uint32_t)row->size ? row->size : (int)col;
+    if (!row->colindex && row->rsize == row->size) return c;  /* No TABs */
 
-    /* Parse just this row for simple highlighting */
-    TSTree *tree = ts_parser_parse_string(ts->parser, NULL, row->render, (uint32_t)row->rsize);
-    if (!tree) {
-        return;
-    }
+    int rx = editor_row_cx_to_rx(row, c) - row->render_off;
+    if (rx < 0) return 0;
+    return rx > row->rsize ? row->rsize : rx;
+}
 
-    TSNode root = ts_tree_root_node(tree);
+void treesitter_update_rows(editor_ctx_t *ctx, TreeSitterState *ts,
+                            int first, int last) {
+    if (!ctx || !ts || !ts->tree || !ts->cursor) return;
+    if (!ts->query) ts->query = highlight_query(ts->lang_name, ts->language);
+    if (!ts->query) return;
+    if (first < 0) first = 0;
+    if (last > ctx->model.numrows) last = ctx->model.numrows;
+    if (first >= last) return;
+
+    if (ts->stale) {
+        /* Shifted by the edits but not reparsed: redo once it is */
+        if (ts->approx_from >= ts->approx_to) {
+            ts->approx_from = first;
+            ts->approx_to = last;
+        } else {
+            if (first < ts->approx_from) ts->approx_from = first;
+            if (last > ts->approx_to) ts->approx_to = last;
+        }
+    }
 
-    /* Execute query */
-    ts_query_cursor_exec(ts->cursor, ts->query, root);
+    /* Only matches touching these lines */
+    TSPoint range_start = { (uint32_t)first, 0 };
+    TSPoint range_end = { (uint32_t)last, 0 };
+    ts_query_cursor_set_point_range(ts->cursor, range_start, range_end);
+    ts_query_cursor_exec(ts->cursor, ts->query, ts_tree_root_node(ts->tree));
 
-    /* Apply captures to highlight array */
+    /* Apply captures to highlight arrays */
     TSQueryMatch match;
     uint32_t capture_index;
 
     while (ts_query_cursor_next_capture(ts->cursor, &match, &capture_index)) {
         TSQueryCapture capture = match.captures[capture_index];
-        uint32_t start = ts_node_start_byte(capture.node);
-        uint32_t end = ts_node_end_byte(capture.node);
+        TSPoint sp = ts_node_start_point(capture.node);
+        TSPoint ep = ts_node_end_point(capture.node);
         uint32_t name_len;
         const char *capture_name;
         int hl_type;
 
         capture_name = ts_query_capture_name_for_id(ts->query, capture.index, &name_len);
         hl_type = capture_to_hl(capture_name, name_len);
+        if (hl_type == HL_NORMAL) continue;
 
-        if (start < (uint32_t)row->rsize && hl_type != HL_NORMAL) {
-            if (end > (uint32_t)row->rsize) {
-                end = (uint32_t)row->rsize;
-            }
-            for (uint32_t i = start; i < end; i++) {
+        /* Nodes spanning lines (block comments, long strings) cover the
+         * whole of the lines between their ends */
+        int r0 = sp.row < (uint32_t)first ? first : (int)sp.row;
+        int r1 = ep.row >= (uint32_t)last ? last - 1 : (int)ep.row;
+        for (int r = r0; r <= r1; r++) {
+            t_erow *row = &ctx->model.row[r];
+            int start = (uint32_t)r == sp.row ? hl_col(row, sp.column) : 0;
+            int end = (uint32_t)r == ep.row ? hl_col(row, ep.column) : row->rsize;
+            for (int i = start; i < end; i++) {
                 /* Only set if not already set (first match wins) */
-                if (row->hl[i] == HL_NORMAL) {
-                    row->hl[i] = (unsigned char)hl_type;
+                if (row->hl_buf.hl[i] == HL_NORMAL) {
+                    row->hl_buf.hl[i] = (unsigned char)hl_type;
                 }
             }
         }
     }
+}
+
+/* ======================== Structure ======================== */
+
+/* Compiled indent and fold queries, as the tag queries below */
+static TsPatternQuery indent_queries[] = {
+    {"lua", LUA_INDENT_PATTERNS, NULL, 0},
+    {"python", PYTHON_INDENT_PATTERNS, NULL, 0},
+    {"scheme", SCHEME_INDENT_PATTERNS, NULL, 0},
+    {NULL, NULL, NULL, 0}
+};
+
+static TsPatternQuery fold_queries[] = {
+    {"lua", LUA_FOLD_PATTERNS, NULL, 0},
+    {"python", PYTHON_FOLD_PATTERNS, NULL, 0},
+    {"scheme", SCHEME_FOLD_PATTERNS, NULL, 0},
+    {"markdown", MARKDOWN_FOLD_PATTERNS, NULL, 0},
+    {NULL, NULL, NULL, 0}
+};
+
+static int capture_is(const TSQuery *query, uint32_t id, const char *name) {
+    uint32_t len;
+    const char *cname = ts_query_capture_name_for_id(query, id, &len);
+    return strlen(name) == len && memcmp(cname, name, len) == 0;
+}
+
+static int point_before(TSPoint a, TSPoint b) {
+    return a.row < b.row || (a.row == b.row && a.column < b.column);
+}
+
+/* The rows [first, last] a node spans: one ending at the start of a row
+ * ends on the row before */
+static void node_rows(TSNode node, uint32_t *first, uint32_t *last) {
+    TSPoint sp = ts_node_start_point(node);
+    TSPoint ep = ts_node_end_point(node);
+    *first = sp.row;
+    *last = ep.column == 0 && ep.row > sp.row ? ep.row - 1 : ep.row;
+}
+
+int treesitter_indent_ready(TreeSitterState *ts) {
+    return ts && ts->tree &&
+           pattern_query(indent_queries, ts->lang_name, ts->language) != NULL;
+}
+
+int treesitter_indent(TreeSitterState *ts, int row, int col, int closing,
+                      int *anchor) {
+    if (!ts || !ts->tree || row < 0 || col < 0) return TS_INDENT_UNKNOWN;
+    TSQuery *query = pattern_query(indent_queries, ts->lang_name, ts->language);
+    if (!query) return TS_INDENT_UNKNOWN;
+
+    /* An error around the line leaves its place in the tree a guess */
+    TSNode root = ts_tree_root_node(ts->tree);
+    TSPoint at = { (uint32_t)row, (uint32_t)col };
+    for (TSNode n = ts_node_descendant_for_point_range(root, at, at);
+         !ts_node_is_null(n); n = ts_node_parent(n))
+        if (ts_node_is_error(n) || ts_node_is_missing(n)) return TS_INDENT_UNKNOWN;
+
+    /* Only the nodes around the line's first character: those holding
+     * it, and the one starting there */
+    TSQueryCursor *cursor = take_cursor();
+    if (!cursor) return TS_INDENT_UNKNOWN;
+    TSPoint next = { at.row, at.column + 1 };
+    ts_query_cursor_set_point_range(cursor, at, next);
+    ts_query_cursor_exec(cursor, query, root);
+    TSNode inner = {{0}, NULL, NULL};
+    int branch = closing;
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+        for (uint16_t i = 0; i < match.capture_count; i++) {
+            TSNode node = match.captures[i].node;
+            TSPoint sp = ts_node_start_point(node);
+            if (capture_is(query, match.captures[i].index, "branch")) {
+                if (sp.row == at.row && sp.column == at.column) branch = 1;
+            } else if (sp.row < at.row && point_before(at, ts_node_end_point(node)) &&
+                       (ts_node_is_null(inner) ||
+                        ts_node_start_byte(node) > ts_node_start_byte(inner))) {
+                inner = node;
+            }
+        }
+    }
+    give_cursor(cursor);
 
+    if (ts_node_is_null(inner)) return TS_INDENT_TOP;
+    *anchor = (int)ts_node_start_point(inner).row;
+    return branch ? TS_INDENT_SAME : TS_INDENT_DEEPER;
+}
+
+/* Every named node spanning rows, when the language has no fold query */
+static void fold_named_nodes(TSNode root, TsFoldFn fn, void *opaque) {
+    /* Preorder walk below the root, skipping the subtrees of nodes
+     * within one row */
+    TSTreeCursor cursor = ts_tree_cursor_new(root);
+    for (;;) {
+        TSNode node = ts_tree_cursor_current_node(&cursor);
+        uint32_t first, last;
+        node_rows(node, &first, &last);
+        int descend = last > first;
+
+        if (descend && ts_node_is_named(node) && !ts_node_eq(node, root))
+            fn(opaque, (int)first, (int)last);
+        if (descend && ts_tree_cursor_goto_first_child(&cursor)) continue;
+        while (!ts_tree_cursor_goto_next_sibling(&cursor)) {
+            if (!ts_tree_cursor_goto_parent(&cursor)) {
+                ts_tree_cursor_delete(&cursor);
+                return;
+            }
+        }
+    }
+}
+
+void treesitter_fold_ranges(TreeSitterState *ts, TsFoldFn fn, void *opaque) {
+    if (!ts || !ts->tree) return;
+    TSNode root = ts_tree_root_node(ts->tree);
+    TSQuery *query = pattern_query(fold_queries, ts->lang_name, ts->language);
+    TSQueryCursor *cursor = query ? take_cursor() : NULL;
+    if (!cursor) {
+        fold_named_nodes(root, fn, opaque);
+        return;
+    }
+    ts_query_cursor_exec(cursor, query, root);
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+        for (uint16_t i = 0; i < match.capture_count; i++) {
+            uint32_t first, last;
+            node_rows(match.captures[i].node, &first, &last);
+            if (last > first) fn(opaque, (int)first, (int)last);
+        }
+    }
+    give_cursor(cursor);
+}
+
+int treesitter_fold_at(TreeSitterState *ts, int row, int *first, int *last) {
+    if (!ts || !ts->tree || row < 0) return 0;
+    TSNode root = ts_tree_root_node(ts->tree);
+    TSQuery *query = pattern_query(fold_queries, ts->lang_name, ts->language);
+    TSPoint at = { (uint32_t)row, 0 };
+    TSPoint next = { (uint32_t)row + 1, 0 };
+    uint32_t best_first = 0, best_last = 0;
+    int found = 0;
+
+    if (query) {
+        /* The innermost @fold around the row, from the nodes over it */
+        TSQueryCursor *cursor = take_cursor();
+        if (!cursor) return 0;
+        ts_query_cursor_set_point_range(cursor, at, next);
+        ts_query_cursor_exec(cursor, query, root);
+        TSQueryMatch match;
+        while (ts_query_cursor_next_match(cursor, &match)) {
+            for (uint16_t i = 0; i < match.capture_count; i++) {
+                uint32_t f, l;
+                node_rows(match.captures[i].node, &f, &l);
+                if (l > f && f <= at.row && at.row <= l &&
+                    (!found || l - f < best_last - best_first)) {
+                    best_first = f;
+                    best_last = l;
+                    found = 1;
+                }
+            }
+        }
+        give_cursor(cursor);
+    } else {
+        /* The innermost named node over the row's text spanning rows */
+        TSNode n = ts_node_named_descendant_for_point_range(root, at, at);
+        for (; !ts_node_is_null(n) && !ts_node_eq(n, root); n = ts_node_parent(n)) {
+            node_rows(n, &best_first, &best_last);
+            if (best_last > best_first) {
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (!found) return 0;
+    *first = (int)best_first;
+    *last = (int)best_last;
+    return 1;
+}
+
+static void set_range(TsRange *range, TSNode node) {
+    TSPoint ns = ts_node_start_point(node), ne = ts_node_end_point(node);
+    range->start_row = (int)ns.row;
+    range->start_col = (int)ns.column;
+    range->end_row = (int)ne.row;
+    range->end_col = (int)ne.column;
+}
+
+int treesitter_grow_node(TreeSitterState *ts, TsRange *range) {
+    if (!ts || !ts->tree || !range) return 0;
+    TSNode root = ts_tree_root_node(ts->tree);
+    TSPoint start = { (uint32_t)range->start_row, (uint32_t)range->start_col };
+    TSPoint end = { (uint32_t)range->end_row, (uint32_t)range->end_col };
+
+    /* Up from the smallest node holding the range, to one holding more */
+    TSNode n = ts_node_named_descendant_for_point_range(root, start, end);
+    while (!ts_node_is_null(n) &&
+           (!ts_node_is_named(n) ||
+            (!point_before(ts_node_start_point(n), start) &&
+             !point_before(end, ts_node_end_point(n)))))
+        n = ts_node_parent(n);
+    if (ts_node_is_null(n)) return 0;
+    set_range(range, n);
+    return 1;
+}
+
+int treesitter_shrink_node(TreeSitterState *ts, TsRange *range, int row, int col) {
+    if (!ts || !ts->tree || !range) return 0;
+    TSNode root = ts_tree_root_node(ts->tree);
+    TSPoint start = { (uint32_t)range->start_row, (uint32_t)range->start_col };
+    TSPoint end = { (uint32_t)range->end_row, (uint32_t)range->end_col };
+    TSPoint at = { (uint32_t)row, (uint32_t)col };
+
+    /* Up from the smallest node at the point, while inside the range */
+    TSNode best = {{0}, NULL, NULL};
+    TSNode n = ts_node_named_descendant_for_point_range(root, at, at);
+    for (; !ts_node_is_null(n); n = ts_node_parent(n)) {
+        TSPoint ns = ts_node_start_point(n), ne = ts_node_end_point(n);
+        if (point_before(ns, start) || point_before(end, ne)) break;
+        if (ts_node_is_named(n) && (point_before(start, ns) || point_before(ne, end)))
+            best = n;
+    }
+    if (ts_node_is_null(best)) return 0;
+    set_range(range, best);
+    return 1;
+}
+
+/* ======================== Tags ======================== */
+
+/* Compiled tag queries, by language, built on first use and never freed */
+static TsPatternQuery tag_queries[] = {
+    {"lua", LUA_TAGS_PATTERNS, NULL, 0},
+    {"python", PYTHON_TAGS_PATTERNS, NULL, 0},
+    {"scheme", SCHEME_TAGS_PATTERNS, NULL, 0},
+    {"haskell", HASKELL_TAGS_PATTERNS, NULL, 0},
+    {"markdown", MARKDOWN_TAGS_PATTERNS, NULL, 0},
+    {NULL, NULL, NULL, 0}
+};
+
+/* Whether the text of the capture with id 'id' in 'match' is one of the
+ * strings of steps [from, to). */
+static int tag_capture_is(const TSQuery *query, const TSQueryMatch *match,
+                          uint32_t id, const TSQueryPredicateStep *steps,
+                          uint32_t from, uint32_t to, const char *text) {
+    for (uint16_t i = 0; i < match->capture_count; i++) {
+        if (match->captures[i].index != id) continue;
+        TSNode node = match->captures[i].node;
+        uint32_t start = ts_node_start_byte(node);
+        uint32_t len = ts_node_end_byte(node) - start;
+        for (uint32_t s = from; s < to; s++) {
+            if (steps[s].type != TSQueryPredicateStepTypeString) continue;
+            uint32_t vlen;
+            const char *v = ts_query_string_value_for_id(query, steps[s].value_id,
+                                                         &vlen);
+            if (vlen == len && memcmp(v, text + start, len) == 0) return 1;
+        }
+        return 0;
+    }
+    return 1;   /* Not captured: nothing to check */
+}
+
+/* Whether the match passes its #eq? and #any-of? predicates (the query
+ * cursor leaves text predicates to its caller). Others are not checked. */
+static int tag_predicates_hold(const TSQuery *query, const TSQueryMatch *match,
+                               const char *text) {
+    uint32_t nsteps;
+    const TSQueryPredicateStep *steps =
+        ts_query_predicates_for_pattern(query, match->pattern_index, &nsteps);
+    uint32_t at = 0;
+    while (at < nsteps) {
+        uint32_t end = at;
+        while (end < nsteps && steps[end].type != TSQueryPredicateStepTypeDone) end++;
+        if (end - at >= 3 && steps[at].type == TSQueryPredicateStepTypeString &&
+            steps[at + 1].type == TSQueryPredicateStepTypeCapture) {
+            uint32_t len;
+            const char *op = ts_query_string_value_for_id(query, steps[at].value_id, &len);
+            if ((strcmp(op, "eq?") == 0 || strcmp(op, "any-of?") == 0) &&
+                !tag_capture_is(query, match, steps[at + 1].value_id, steps,
+                                at + 2, end, text))
+                return 0;
+        }
+        at = end + 1;
+    }
+    return 1;
+}
+
+int treesitter_tags(const char *lang_name, const char *text, size_t len,
+                    TsTagFn fn, void *opaque) {
+    if (!lang_name || len > UINT32_MAX) return -1;
+    const TSLanguage *language = treesitter_get_language(lang_name);
+    if (!language) return -1;
+    TSQuery *query = pattern_query(tag_queries, lang_name, language);
+    if (!query) return -1;
+
+    TSParser *parser = take_parser(language);
+    if (!parser) return -1;
+    TSTree *tree = ts_parser_parse_string(parser, NULL, text, (uint32_t)len);
+    give_parser(parser);
+    if (!tree) return -1;
+
+    TSQueryCursor *cursor = take_cursor();
+    if (!cursor) {
+        ts_tree_delete(tree);
+        return -1;
+    }
+    ts_query_cursor_exec(cursor, query, ts_tree_root_node(tree));
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+        int kind = -1;
+        TSNode name = {{0}, NULL, NULL};
+        for (uint16_t i = 0; i < match.capture_count; i++) {
+            uint32_t clen;
+            const char *cname = ts_query_capture_name_for_id(
+                query, match.captures[i].index, &clen);
+            if (clen == 4 && memcmp(cname, "name", 4) == 0)
+                name = match.captures[i].node;
+            else if (strcmp(cname, "definition.function") == 0)
+                kind = TS_TAG_FUNCTION;
+            else if (strcmp(cname, "definition.type") == 0)
+                kind = TS_TAG_TYPE;
+            else if (strcmp(cname, "definition.heading") == 0)
+                kind = TS_TAG_HEADING;
+        }
+        if (kind < 0 || ts_node_is_null(name)) continue;
+        if (!tag_predicates_hold(query, &match, text)) continue;
+        uint32_t start = ts_node_start_byte(name);
+        fn(opaque, text + start, ts_node_end_byte(name) - start, kind,
+           (int)ts_node_start_point(name).row);
+    }
+    give_cursor(cursor);
     ts_tree_delete(tree);
+    return 0;
+}
+
+void treesitter_update_row(editor_ctx_t *ctx, t_erow *row, TreeSitterState *ts) {
+    if (!ctx || !row) return;
+
+    int at = editor_row_index(ctx, row);
+    if (at >= 0) treesitter_update_rows(ctx, ts, at, at + 1);
 }
 
 #endif /* LOKI_USE_LINENOISE */
@@ -13,28 +13,48 @@
 
 #include <tree_sitter/api.h>
 #include <stddef.h>
+#include "async_queue.h"
+
+/* Async event carrying a finished background parse (data.user.i64[0] =
+ * job id) */
+#define TS_PARSE_ASYNC_EVENT (ASYNC_EVENT_USER + 1)
+
+/* Documents at least this big are parsed on a worker thread */
+#define TS_ASYNC_MIN_BYTES (256 * 1024)
 
 /* Forward declarations - types are defined in internal.h */
 struct editor_ctx;
 struct t_erow;
+struct EditorModel;
 
 /**
  * Tree-sitter state for a buffer.
  */
 typedef struct TreeSitterState {
-    TSParser *parser;
+    TSParser *parser;       /* From the pool, given back when freed */
     TSTree *tree;
-    TSQuery *query;
-    TSQueryCursor *cursor;
+    TSQuery *query;         /* The language's, shared: never freed; NULL
+                             * until the first highlighting compiles it */
+    TSQueryCursor *cursor;  /* From the pool, like the parser */
     const TSLanguage *language;
-    char *source;           /* Copy of source for reparsing */
-    size_t source_len;
-    size_t source_cap;
+    const char *lang_name;  /* As treesitter_init() was given, kept */
+    int stale;              /* Edits noted since the tree was parsed */
+    int byte_row;           /* Row whose start byte is cached, -1 if none */
+    uint32_t byte_off;      /* Start byte of byte_row */
+    uint64_t edit_gen;      /* Bumped by every noted edit and reset */
+    TSParser *bg_parser;    /* Used by the background parse only */
+    struct TsParseJob *job; /* Background parse in flight, or NULL */
+    int approx_from;        /* Rows highlighted from a tree not yet */
+    int approx_to;          /*   reparsed after edits: [from, to) */
 } TreeSitterState;
 
 /**
  * Initialize tree-sitter for a language.
  *
+ * The highlight query is compiled when the language's first buffer is
+ * first highlighted, not here, and shared by the rest; parsers and query cursors come from pools that
+ * closed buffers give theirs back to.
+ *
  * @param lang_name Language name (e.g., "lua", "python", "scheme")
  * @return Tree-sitter state, or NULL if language unavailable
  */
@@ -48,7 +68,10 @@ TreeSitterState *treesitter_init(const char *lang_name);
 void treesitter_free(TreeSitterState *ts);
 
 /**
- * Update highlighting for a row using tree-sitter.
+ * Update highlighting for a row from the document tree.
+ *
+ * Runs the highlight query over the row's lines only. The tree must be
+ * current (see treesitter_sync()); a row without a tree is left as is.
  *
  * @param ctx Editor context (for HL_* mapping)
  * @param row Row to highlight
@@ -56,6 +79,21 @@ void treesitter_free(TreeSitterState *ts);
  */
 void treesitter_update_row(struct editor_ctx *ctx, struct t_erow *row, TreeSitterState *ts);
 
+/**
+ * Update highlighting for rows [first, last) from the document tree.
+ *
+ * One query cursor pass covers the whole range, so a node spanning many
+ * rows is visited once. Captures are written into the rows' hl arrays,
+ * which the caller has reset to HL_NORMAL.
+ *
+ * @param ctx Editor context
+ * @param ts Tree-sitter state
+ * @param first First row
+ * @param last One past the last row
+ */
+void treesitter_update_rows(struct editor_ctx *ctx, TreeSitterState *ts,
+                            int first, int last);
+
 /**
  * Notify tree-sitter of an edit for incremental parsing.
  *
@@ -65,13 +103,177 @@ void treesitter_update_row(struct editor_ctx *ctx, struct t_erow *row, TreeSitte
 void treesitter_edit(TreeSitterState *ts, TSInputEdit *edit);
 
 /**
- * Reparse the buffer after edits.
+ * Reparse the buffer straight from the model's rows.
+ *
+ * The parser pulls text through a TSInput callback that returns spans of
+ * the row buffers, so no copy of the document is made. Reuses the
+ * current tree (after treesitter_edit()) for incremental parsing.
+ *
+ * @param ts Tree-sitter state
+ * @param model Document to parse
+ */
+void treesitter_reparse_model(TreeSitterState *ts, const struct EditorModel *model);
+
+/**
+ * Record an edit of the model for the next incremental reparse.
+ *
+ * Positions are (row, byte column in row->chars); every row is followed by
+ * a newline in the parsed text. Call before or after the edit: only rows
+ * above start.row are looked at, and an edit never changes them.
+ *
+ * @param ts Tree-sitter state
+ * @param model Document being edited
+ * @param start Where the edit starts
+ * @param old_end End of the replaced text, in the old document
+ * @param old_len Bytes replaced
+ * @param new_end End of the new text, in the new document
+ * @param new_len Bytes inserted
+ */
+void treesitter_note_edit(TreeSitterState *ts, const struct EditorModel *model,
+                          TSPoint start, TSPoint old_end, uint32_t old_len,
+                          TSPoint new_end, uint32_t new_len);
+
+/**
+ * Forget the tree after the model changed in ways no edit was noted for
+ * (a file load, a row rewritten in place). The next sync parses from
+ * scratch.
+ *
+ * @param ts Tree-sitter state
+ */
+void treesitter_reset(TreeSitterState *ts);
+
+/**
+ * Bring the tree up to date with the model.
+ *
+ * Reparses incrementally when edits were noted or there is no tree. Rows
+ * whose syntax may have changed (besides the edited rows themselves, whose
+ * highlight is already stale) are reported as [*from, *to).
+ *
+ * Documents of TS_ASYNC_MIN_BYTES or more are parsed on a worker thread
+ * instead, from a snapshot of the text, when the async event queue runs.
+ * The call then returns 0 at once and rows keep being highlighted from the
+ * last tree, shifted by the edits. The new tree is installed when the
+ * worker's event is dispatched, and the rows it changes are marked stale.
+ * An edit made meanwhile cancels the parse; the next sync starts over.
  *
  * @param ts Tree-sitter state
- * @param source Source text
- * @param len Length of source
+ * @param model Document to parse
+ * @param from First changed row
+ * @param to One past the last changed row
+ * @return 1 if rows must be re-highlighted, 0 otherwise
+ */
+int treesitter_sync(TreeSitterState *ts, const struct EditorModel *model,
+                    int *from, int *to);
+
+/**
+ * Like treesitter_sync(), but always parsing on this thread, cancelling a
+ * background parse: for features that need the tree at once.
+ */
+int treesitter_sync_here(TreeSitterState *ts, const struct EditorModel *model,
+                         int *from, int *to);
+
+/* What treesitter_indent() says of a line */
+#define TS_INDENT_UNKNOWN -1    /* The tree can't say */
+#define TS_INDENT_TOP 0         /* Not indented */
+#define TS_INDENT_SAME 1        /* As the anchor row */
+#define TS_INDENT_DEEPER 2      /* One level deeper than the anchor row */
+
+/**
+ * Whether the language has an indent query and there is a tree to run it
+ * on (current or not).
+ */
+int treesitter_indent_ready(TreeSitterState *ts);
+
+/**
+ * How the line whose text starts at (row, col) should be indented, by the
+ * language's indent query run over the nodes around that point only.
+ * The innermost @indent node holding the line, starting on a row above,
+ * puts it one level deeper than that row (*anchor); a @branch node
+ * starting the line, or 'closing' (a closing bracket being typed), at the
+ * same level instead.
+ *
+ * @param ts Tree-sitter state; its tree may be edited since the parse
+ * @param row Row of the line
+ * @param col Column (byte) of its first non-blank character
+ * @param closing Whether the line starts with a closing bracket the tree
+ *        may not hold yet
+ * @param anchor Set to the row to follow, for TS_INDENT_SAME and _DEEPER
+ * @return TS_INDENT_*; TS_INDENT_UNKNOWN without a query or tree, or with
+ *         a syntax error around the point
+ */
+int treesitter_indent(TreeSitterState *ts, int row, int col, int closing,
+                      int *anchor);
+
+/**
+ * Report the nodes that fold, as row ranges [first, last], for folding
+ * (fold_from_syntax()): the @fold nodes of the language's fold query
+ * spanning rows, or without one every named node below the root that
+ * does. A node ending at the start of a row ends on the row before it.
+ *
+ * @param ts Tree-sitter state
+ * @param fn Called with each range, enclosing nodes first
+ * @param opaque Passed to fn
+ */
+typedef void (*TsFoldFn)(void *opaque, int first, int last);
+void treesitter_fold_ranges(TreeSitterState *ts, TsFoldFn fn, void *opaque);
+
+/**
+ * The rows [*first, *last] of the innermost foldable node around 'row':
+ * a @fold of the language's fold query, or a named node spanning rows.
+ * Only the nodes over the row are looked at.
+ *
+ * @return 1 if there is one, 0 otherwise
+ */
+int treesitter_fold_at(TreeSitterState *ts, int row, int *first, int *last);
+
+/* A range of the text, end exclusive, in rows and byte columns */
+typedef struct TsRange {
+    int start_row, start_col;
+    int end_row, end_col;
+} TsRange;
+
+/**
+ * Grow 'range' to the smallest named node holding more than it.
+ *
+ * @return 1 if 'range' was changed, 0 if there is no such node
+ */
+int treesitter_grow_node(TreeSitterState *ts, TsRange *range);
+
+/**
+ * Shrink 'range' to the largest named node inside it that holds the point
+ * (row, col): where growing it started, to undo that.
+ *
+ * @return 1 if 'range' was changed, 0 if there is no such node
+ */
+int treesitter_shrink_node(TreeSitterState *ts, TsRange *range, int row, int col);
+
+/* Kinds of definitions found by treesitter_tags() */
+enum {
+    TS_TAG_FUNCTION = 0,    /* Functions and methods */
+    TS_TAG_TYPE,            /* Classes and types */
+    TS_TAG_HEADING,         /* Markdown headings */
+    TS_TAG_KINDS
+};
+
+/**
+ * Find the definitions in a file's text with the language's tag query,
+ * the way tree-sitter's tags.scm queries mark them: a @definition.<kind>
+ * capture, named by the @name capture of the same match. Safe on any
+ * thread: each call has a parser of its own, and the compiled queries are
+ * shared read-only.
+ *
+ * @param lang_name Language name (treesitter_lang_from_filename())
+ * @param text The file's text
+ * @param len Its length
+ * @param fn Called with each definition's name (not NUL-terminated), its
+ *           kind (TS_TAG_*) and the 0-based row of the name, in order
+ * @param opaque Passed to fn
+ * @return 0, or -1 if the language has no tag query or parser
  */
-void treesitter_reparse(TreeSitterState *ts, const char *source, size_t len);
+typedef void (*TsTagFn)(void *opaque, const char *name, uint32_t len,
+                        int kind, int row);
+int treesitter_tags(const char *lang_name, const char *text, size_t len,
+                    TsTagFn fn, void *opaque);
 
 /**
  * Get tree-sitter language from language name.
@@ -2,18 +2,48 @@
  *
  * Implements undo/redo with operation grouping and memory limits.
  * Operations are grouped by heuristics (time gap, cursor movement, operation type).
+ *
+ * Each group is a node of the undo tree. Nodes live in one array, in the
+ * order they were made, so a group's number is its slot plus a base that
+ * grows as slots are dropped from the front; entries live in another,
+ * each node's in one contiguous slice (a node only gains entries while it
+ * is the newest). The text the entries hold is carved from a slab arena
+ * of the history's own. Dropping nodes leaves dead slots behind, which
+ * are compacted away once they outnumber the live ones.
+ *
+ * The history's memory counts everything it holds: entry and node slots,
+ * row lists and text blocks at their allocated sizes. Past the limit,
+ * the oldest groups are packed first: serialized as for the journal and
+ * compressed into one block, their entry slots given up. A packed group
+ * is unpacked, into a fresh slice at the end of the entries, when undo
+ * or redo goes through it. Only when nothing is left to pack are groups
+ * dropped.
+ *
+ * A node is written to the journal when it closes, with the record of
+ * its parent, so every record's parent comes before it. The groups read
+ * back from the journal go in front of the arrays, numbered so that the
+ * ones made since the file was opened keep their numbers. Nothing is
+ * written, nor looked for, until the history is first used: opening a
+ * file only hashes its text, on the task pool.
  */
 
+#define _DEFAULT_SOURCE     /* strdup() */
+
 #include "undo.h"
 #include "internal.h"
+#include "arena.h"
+#include "memstats.h"
+#include "undo_journal.h"
+#include "lz.h"
+#include "model_snapshot.h"
+#include "task_pool.h"
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <stdio.h>
 
 /* Forward declarations of editor functions we need */
-void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
-void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at);
 void editor_insert_row(editor_ctx_t *ctx, int at, char *s, size_t len);
 void editor_del_row(editor_ctx_t *ctx, int at);
 
@@ -21,16 +51,82 @@ void editor_del_row(editor_ctx_t *ctx, int at);
 #define UNDO_GROUP_TIMEOUT 2         /* 2 seconds gap = new group */
 #define UNDO_GROUP_MOVEMENT_GAP 2    /* Cursor moved >2 positions = new group */
 
+/* Dead slots tolerated before the arrays are compacted */
+#define UNDO_COMPACT_MIN 256
+
+/* One group of the undo tree. Its entries turn its parent's state into
+ * its own. Node links are slots, -1 for none (or for the root, the
+ * oldest state kept, which is not a node). */
+typedef struct undo_node {
+    int parent;
+    int first_child;         /* Children, newest first */
+    int next_sibling;
+    int redo_child;          /* Where redo goes: the child last left or made */
+    int first, count;        /* Slice of undo->entries */
+    int depth;               /* Nodes from the root, less depth_base */
+    int path;                /* Entries from the root, less path_base */
+    time_t time;             /* Of the group's last edit */
+    int live;                /* 0 once dropped */
+    long long record;        /* Offset in the journal, -1 if not there */
+    char *pack;              /* The entries packed, or NULL (first is
+                              * then -1) */
+    int pack_cap, pack_len;
+    int raw_len;             /* Bytes of the entries serialized */
+    int pack_text;           /* Bytes of text in them */
+} undo_node_t;
+
 /* Undo state (private to this module) */
 struct undo_state {
-    undo_entry_t *entries;   /* Circular buffer of undo entries */
-    int capacity;            /* Max entries (e.g., 1000) */
-    int count;               /* Current number of entries */
-    int head;                /* Write position (next entry goes here) */
-    int current;             /* Current position in undo stack */
-
-    int next_group_id;       /* Next group ID to assign */
-    int current_group_id;    /* Current operation group */
+    undo_node_t *nodes;      /* Every group, oldest first */
+    int nnodes, nodes_cap;
+    int node_head;           /* No live node before this slot */
+    int node_base;           /* Number of the group in slot 0 */
+    int live_nodes;
+
+    undo_entry_t *entries;   /* The nodes' entries, slice after slice */
+    int nentries, entries_cap;
+    int live_entries;        /* In live nodes, packed or not */
+    int packed_entries;      /* Of those, in packed nodes (no slot) */
+    int capacity;            /* Max live entries (e.g., 1000) */
+    int pack_from;           /* No node before this slot can be packed */
+
+    int root_first;          /* Children of the root */
+    int root_redo;
+    int root_seq;            /* Number of the root state */
+    time_t root_time;
+
+    int cur;                 /* Node of the current state, -1 for the root */
+    int cur_top;             /* Child of the root 'cur' descends from */
+    int open;                /* Node taking new entries, -1 after a break */
+    int held;                /* undo_hold_group() calls not released */
+    int depth_base, path_base;
+
+    int *stack;              /* Scratch list of slots */
+    int stack_cap;
+
+    RowArena *arena;         /* Entry text */
+
+    /* Persistent history (see undo_journal.h) */
+    UndoJournal *journal;    /* NULL when not kept */
+    char *journal_path;      /* The file it is for */
+    long long root_record;   /* Record of the root state, -1 for the text
+                              * as first opened */
+    int depth_origin;        /* Depth in the journal of a node of depth 0 */
+    long long opened_record; /* Record of the state the file was opened
+                              * in, while its history is not read yet */
+    EditorSnapshot *opened_text; /* The text as opened, until the journal
+                              * is started (journal_start()) */
+    Task *hash_task;         /* Hashing it into opened_hash */
+    TaskToken hash_token;
+    uint64_t opened_hash;
+    char *jbuf;              /* Groups being serialized */
+    size_t jlen, jcap;
+    char *zbuf;              /* A group being packed */
+    size_t zcap;
+
+    /* Crash recovery (see undo_set_recorder()) */
+    UndoRecorder recorder;
+    void *recorder_data;
 
     /* Grouping heuristics */
     time_t last_edit_time;   /* Timestamp of last edit */
@@ -39,33 +135,38 @@ struct undo_state {
     undo_op_type_t last_op;  /* Type of last operation */
 
     /* Memory tracking */
-    size_t memory_used;      /* Bytes used by undo data */
-    size_t memory_limit;     /* Max bytes (e.g., 10MB) */
+    size_t memory_used;      /* Bytes held: slots, lists and blocks */
+    size_t text_used;        /* Bytes of text in them */
+    size_t memory_limit;     /* Max bytes held (e.g., 10MB) */
 };
 
+static void close_group(struct undo_state *undo);
+static void journal_drop(struct undo_state *undo);
+static void journal_start(struct undo_state *undo);
+static void import_history(struct undo_state *undo);
+static void rows_shrink(undo_rows_t *rows);
+
 /* ======================== Initialization ======================== */
 
 void undo_init(editor_ctx_t *ctx, int capacity, size_t memory_limit) {
-    struct undo_state *undo = malloc(sizeof(struct undo_state));
+    struct undo_state *undo = calloc(1, sizeof(struct undo_state));
     if (!undo) return;
 
-    undo->entries = calloc(capacity, sizeof(undo_entry_t));
-    if (!undo->entries) {
+    undo->arena = arena_create();
+    if (!undo->arena) {
         free(undo);
         return;
     }
+    arena_set_tag(undo->arena, MEM_TAG_UNDO);
 
     undo->capacity = capacity;
-    undo->count = 0;
-    undo->head = 0;
-    undo->current = 0;
-    undo->next_group_id = 1;
-    undo->current_group_id = 0;
-    undo->last_edit_time = 0;
+    undo->node_base = 1;
+    undo->root_first = undo->root_redo = -1;
+    undo->cur = undo->cur_top = undo->open = -1;
+    undo->root_record = undo->opened_record = -1;
     undo->last_edit_row = -1;
     undo->last_edit_col = -1;
     undo->last_op = (undo_op_type_t)-1;
-    undo->memory_used = 0;
     undo->memory_limit = memory_limit;
 
     ctx->model.undo_state = undo;
@@ -76,26 +177,738 @@ void undo_free(editor_ctx_t *ctx) {
 
     struct undo_state *undo = ctx->model.undo_state;
 
-    /* Free all line_op content strings */
-    for (int i = 0; i < undo->count; i++) {
+    /* The open group goes to the journal too */
+    close_group(undo);
+    journal_drop(undo);
+
+    /* Text is in the arena; only REPLACE_ROWS entries own heap blocks */
+    for (int i = 0; i < undo->nentries; i++) {
         undo_entry_t *e = &undo->entries[i];
-        if ((e->type == UNDO_INSERT_LINE || e->type == UNDO_DELETE_LINE) &&
-            e->data.line_op.content) {
-            free(e->data.line_op.content);
+        if (e->type == UNDO_REPLACE_ROWS && e->data.rows_op) {
+            undo_rows_free(e->data.rows_op);
+            free(e->data.rows_op);
         }
     }
 
-    free(undo->entries);
+    arena_destroy(undo->arena);
+    mem_free(MEM_TAG_UNDO, undo->nodes);
+    mem_free(MEM_TAG_UNDO, undo->entries);
+    mem_free(MEM_TAG_UNDO, undo->stack);
+    mem_free(MEM_TAG_UNDO, undo->jbuf);
+    mem_free(MEM_TAG_UNDO, undo->zbuf);
     free(undo);
     ctx->model.undo_state = NULL;
 }
 
+/* ======================== Entry Text ======================== */
+
+/* A block of at least 'need' bytes from the history's arena */
+static char *text_alloc(struct undo_state *undo, size_t need, int *cap) {
+    char *text = arena_alloc(undo->arena, need, cap);
+    if (text == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return text;
+}
+
+/* A NUL-terminated copy of 'len' bytes at 's' */
+static char *text_copy(struct undo_state *undo, const char *s, int len,
+                       int *cap) {
+    char *text = text_alloc(undo, (size_t)len + 1, cap);
+    memcpy(text, s, (size_t)len);
+    text[len] = '\0';
+    return text;
+}
+
+/* Bytes of row contents held by a REPLACE_ROWS entry */
+static size_t rows_op_size(const undo_rows_t *rows) {
+    return rows->old_size + rows->new_size + rows->shared_size;
+}
+
+/* Bytes of text held by a REPLACE_RANGE entry */
+static size_t range_op_size(const undo_entry_t *entry) {
+    return (size_t)entry->data.range_op.old_len + (size_t)entry->data.range_op.new_len;
+}
+
+/* Bytes of text in an entry */
+static size_t entry_text(const undo_entry_t *entry) {
+    switch (entry->type) {
+        case UNDO_INSERT_LINE:
+        case UNDO_DELETE_LINE:
+            return (size_t)entry->data.line_op.length;
+        case UNDO_INSERT_TEXT:
+        case UNDO_DELETE_TEXT:
+            return (size_t)entry->data.text_op.length;
+        case UNDO_REPLACE_ROWS:
+            return rows_op_size(entry->data.rows_op);
+        case UNDO_REPLACE_RANGE:
+            return range_op_size(entry);
+    }
+    return 0;
+}
+
+/* Bytes an entry holds: its slot, and its blocks at their allocated
+ * sizes (shared row contents at their length) */
+static size_t entry_size(const undo_entry_t *entry) {
+    size_t size = sizeof(undo_entry_t);
+    switch (entry->type) {
+        case UNDO_INSERT_LINE:
+        case UNDO_DELETE_LINE:
+            return size + (size_t)entry->data.line_op.cap;
+        case UNDO_INSERT_TEXT:
+        case UNDO_DELETE_TEXT:
+            return size + (size_t)entry->data.text_op.cap;
+        case UNDO_REPLACE_ROWS: {
+            const undo_rows_t *rows = entry->data.rows_op;
+            size_t per_row = 3 * sizeof(int) +
+                             (rows->old_share ? 2 * sizeof(struct RowShare *) : 0);
+            return size + sizeof(undo_rows_t) + (size_t)rows->cap * per_row +
+                   rows->old_cap + rows->new_cap + rows->shared_size;
+        }
+        case UNDO_REPLACE_RANGE:
+            return size + (size_t)entry->data.range_op.cap;
+    }
+    return size;
+}
+
+/* Count an entry that joined the history */
+static void entry_held(struct undo_state *undo, const undo_entry_t *entry) {
+    undo->memory_used += entry_size(entry);
+    undo->text_used += entry_text(entry);
+}
+
+static void free_entry_data(undo_entry_t *entry, struct undo_state *undo) {
+    undo->memory_used -= entry_size(entry);
+    undo->text_used -= entry_text(entry);
+    switch (entry->type) {
+        case UNDO_INSERT_LINE:
+        case UNDO_DELETE_LINE:
+            arena_free(undo->arena, entry->data.line_op.content,
+                       entry->data.line_op.cap);
+            entry->data.line_op.content = NULL;
+            break;
+        case UNDO_INSERT_TEXT:
+        case UNDO_DELETE_TEXT:
+            arena_free(undo->arena, entry->data.text_op.text,
+                       entry->data.text_op.cap);
+            entry->data.text_op.text = NULL;
+            break;
+        case UNDO_REPLACE_ROWS:
+            undo_rows_free(entry->data.rows_op);
+            free(entry->data.rows_op);
+            entry->data.rows_op = NULL;
+            break;
+        case UNDO_REPLACE_RANGE:
+            arena_free(undo->arena, entry->data.range_op.text,
+                       entry->data.range_op.cap);
+            entry->data.range_op.text = NULL;
+            break;
+    }
+}
+
+/* ======================== The Journal ======================== */
+
+/* Room for 'need' more bytes of serialized entries */
+static char *jbuf_reserve(struct undo_state *undo, size_t need) {
+    if (undo->jlen + need > undo->jcap) {
+        size_t cap = undo->jcap ? undo->jcap * 2 : 4096;
+        while (cap < undo->jlen + need) cap *= 2;
+        char *buf = mem_realloc(MEM_TAG_UNDO, undo->jbuf, cap);
+        if (buf == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->jbuf = buf;
+        undo->jcap = cap;
+    }
+    char *p = undo->jbuf + undo->jlen;
+    undo->jlen += need;
+    return p;
+}
+
+static void put_bytes(struct undo_state *undo, const void *data, size_t len) {
+    if (len) memcpy(jbuf_reserve(undo, len), data, len);
+}
+
+static void put_int(struct undo_state *undo, int v) {
+    int32_t n = v;
+    put_bytes(undo, &n, sizeof(n));
+}
+
+/* Serialize 'e': its type, position and cursor, then its text, each
+ * length before the bytes */
+static void encode_entry(struct undo_state *undo, const undo_entry_t *e) {
+    int head[] = { (int)e->type, e->row, e->col, e->cursor_row,
+                   e->cursor_col, e->cursor_rowoff, e->cursor_coloff };
+    for (size_t i = 0; i < sizeof(head) / sizeof(head[0]); i++)
+        put_int(undo, head[i]);
+
+    switch (e->type) {
+        case UNDO_INSERT_TEXT:
+        case UNDO_DELETE_TEXT:
+            put_int(undo, e->data.text_op.length);
+            put_bytes(undo, e->data.text_op.text, (size_t)e->data.text_op.length);
+            break;
+        case UNDO_INSERT_LINE:
+        case UNDO_DELETE_LINE:
+            put_int(undo, e->data.line_op.length);
+            put_bytes(undo, e->data.line_op.content, (size_t)e->data.line_op.length);
+            break;
+        case UNDO_REPLACE_ROWS: {
+            const undo_rows_t *rows = e->data.rows_op;
+            put_int(undo, rows->count);
+            for (int i = 0; i < rows->count; i++) {
+                put_int(undo, rows->row[i]);
+                put_int(undo, rows->old_len[i]);
+                put_int(undo, rows->new_len[i]);
+            }
+            for (int side = 0; side < 2; side++) {
+                const char *text = side ? rows->new_text : rows->old_text;
+                RowShare **share = side ? rows->new_share : rows->old_share;
+                const int *len = side ? rows->new_len : rows->old_len;
+                for (int i = 0; i < rows->count; i++) {
+                    if (share && share[i]) {
+                        put_bytes(undo, share[i]->chars, (size_t)len[i]);
+                    } else {
+                        put_bytes(undo, text, (size_t)len[i]);
+                        text += len[i];
+                    }
+                }
+            }
+            break;
+        }
+        case UNDO_REPLACE_RANGE:
+            put_int(undo, e->data.range_op.old_len);
+            put_int(undo, e->data.range_op.new_len);
+            put_bytes(undo, e->data.range_op.text, range_op_size(e));
+            break;
+    }
+}
+
+/* Serialized entries being read */
+typedef struct {
+    const char *p, *end;
+} entry_reader;
+
+static int get_int(entry_reader *r, int *v) {
+    int32_t n;
+    if ((size_t)(r->end - r->p) < sizeof(n)) return -1;
+    memcpy(&n, r->p, sizeof(n));
+    r->p += sizeof(n);
+    *v = n;
+    return 0;
+}
+
+static const char *get_bytes(entry_reader *r, size_t len) {
+    if ((size_t)(r->end - r->p) < len) return NULL;
+    const char *p = r->p;
+    r->p += len;
+    return p;
+}
+
+/* Read an entry encode_entry() wrote, its text into the arena.
+ * Returns 0, or -1 if it is malformed (nothing is then held). */
+static int decode_entry(struct undo_state *undo, entry_reader *r,
+                        undo_entry_t *e) {
+    int head[7];
+    for (int i = 0; i < 7; i++)
+        if (get_int(r, &head[i]) == -1) return -1;
+    if (head[0] < UNDO_INSERT_TEXT || head[0] > UNDO_REPLACE_RANGE) return -1;
+    memset(e, 0, sizeof(*e));
+    e->type = (undo_op_type_t)head[0];
+    e->row = head[1];
+    e->col = head[2];
+    e->cursor_row = head[3];
+    e->cursor_col = head[4];
+    e->cursor_rowoff = head[5];
+    e->cursor_coloff = head[6];
+
+    int len, new_len;
+    const char *text;
+    switch (e->type) {
+        case UNDO_INSERT_TEXT:
+        case UNDO_DELETE_TEXT:
+            if (get_int(r, &len) == -1 || len < 0 ||
+                !(text = get_bytes(r, (size_t)len)))
+                return -1;
+            e->data.text_op.text = text_copy(undo, text, len, &e->data.text_op.cap);
+            e->data.text_op.length = len;
+            break;
+        case UNDO_INSERT_LINE:
+        case UNDO_DELETE_LINE:
+            if (get_int(r, &len) == -1 || len < 0 ||
+                !(text = get_bytes(r, (size_t)len)))
+                return -1;
+            e->data.line_op.content = text_copy(undo, text, len, &e->data.line_op.cap);
+            e->data.line_op.length = len;
+            break;
+        case UNDO_REPLACE_ROWS: {
+            int count;
+            if (get_int(r, &count) == -1 || count <= 0 ||
+                (size_t)count > (size_t)(r->end - r->p) / 12)
+                return -1;
+            entry_reader meta = *r;
+            size_t old_size = 0, new_size = 0;
+            for (int i = 0; i < count; i++) {
+                int row, old_len;
+                get_int(r, &row);
+                get_int(r, &old_len);
+                get_int(r, &new_len);
+                if (old_len < 0 || new_len < 0) return -1;
+                old_size += (size_t)old_len;
+                new_size += (size_t)new_len;
+            }
+            const char *old_text = get_bytes(r, old_size);
+            const char *new_text = old_text ? get_bytes(r, new_size) : NULL;
+            if (!new_text) return -1;
+
+            undo_rows_t *rows = calloc(1, sizeof(undo_rows_t));
+            if (rows == NULL) {
+                perror("Out of memory");
+                exit(1);
+            }
+            for (int i = 0; i < count; i++) {
+                int row, old_len;
+                get_int(&meta, &row);
+                get_int(&meta, &old_len);
+                get_int(&meta, &new_len);
+                undo_rows_add(rows, row, old_text, old_len, new_text, new_len);
+                old_text += old_len;
+                new_text += new_len;
+            }
+            rows_shrink(rows);
+            e->data.rows_op = rows;
+            break;
+        }
+        case UNDO_REPLACE_RANGE:
+            if (get_int(r, &len) == -1 || get_int(r, &new_len) == -1 ||
+                len < 0 || new_len < 0 || len > INT_MAX - 1 - new_len ||
+                !(text = get_bytes(r, (size_t)len + (size_t)new_len)))
+                return -1;
+            e->data.range_op.text = text_alloc(undo, (size_t)len + (size_t)new_len + 1,
+                                               &e->data.range_op.cap);
+            memcpy(e->data.range_op.text, text, (size_t)len + (size_t)new_len);
+            e->data.range_op.text[len + new_len] = '\0';
+            e->data.range_op.old_len = len;
+            e->data.range_op.new_len = new_len;
+            break;
+    }
+    return 0;
+}
+
+/* Stop keeping the history on disk */
+static void journal_drop(struct undo_state *undo) {
+    if (undo->hash_task) {
+        task_token_cancel(&undo->hash_token);
+        task_wait(undo->hash_task);
+        undo->hash_task = NULL;
+    }
+    editor_snapshot_release(undo->opened_text);
+    undo->opened_text = NULL;
+    undo_journal_close(undo->journal);
+    undo->journal = NULL;
+    free(undo->journal_path);
+    undo->journal_path = NULL;
+    undo->opened_record = -1;
+}
+
+/* Serialize the entries of 'node' into jbuf. Returns 0, or -1 if the
+ * node is packed and its pack does not come back. */
+static int node_serialize(struct undo_state *undo, int node) {
+    const undo_node_t *n = &undo->nodes[node];
+    undo->jlen = 0;
+    if (n->pack) {
+        char *raw = jbuf_reserve(undo, (size_t)n->raw_len);
+        return lz_decompress(n->pack, (size_t)n->pack_len, raw, (size_t)n->raw_len);
+    }
+    for (int i = 0; i < n->count; i++)
+        encode_entry(undo, &undo->entries[n->first + i]);
+    return 0;
+}
+
+/* Append group 'node' to the journal; its parent is there already. A
+ * journal that cannot be written to is given up. */
+static void journal_write(struct undo_state *undo, int node) {
+    undo_node_t *n = &undo->nodes[node];
+    if (!undo->journal || !n->live || n->record >= 0 || n->count == 0) return;
+
+    if (node_serialize(undo, node) == -1) return;
+    UndoJournalRecord rec = {
+        .type = UNDO_JOURNAL_GROUP,
+        .parent = n->parent < 0 ? undo->root_record : undo->nodes[n->parent].record,
+        .depth = n->depth + undo->depth_origin,
+        .count = n->count,
+        .time = n->time,
+        .body = undo->jbuf,
+        .size = undo->jlen,
+    };
+    n->record = undo_journal_append(undo->journal, &rec);
+    if (n->record < 0) journal_drop(undo);
+}
+
+/* The record of the current state, and its depth in the journal */
+static long long state_record(const struct undo_state *undo, int *depth) {
+    if (undo->cur < 0) {
+        *depth = undo->depth_base + undo->depth_origin;
+        return undo->root_record;
+    }
+    *depth = undo->nodes[undo->cur].depth + undo->depth_origin;
+    return undo->nodes[undo->cur].record;
+}
+
+/* Hand the entries of 'node' to the recorder as a 'kind' record */
+static void record_node(struct undo_state *undo, int kind, int node) {
+    if (!undo->recorder || undo->nodes[node].count == 0) return;
+    if (node_serialize(undo, node) == -1) return;
+    undo->recorder(undo->recorder_data, kind, undo->jbuf, undo->jlen,
+                   undo->nodes[node].count);
+}
+
+/* Close the open group, which goes to the journal and the recorder: the
+ * next edit starts a new one */
+static void close_group(struct undo_state *undo) {
+    if (undo->open >= 0) {
+        journal_write(undo, undo->open);
+        record_node(undo, UNDO_RECORD_GROUP, undo->open);
+    }
+    undo->open = -1;
+}
+
+/* ======================== Tree Structure ======================== */
+
+/* The first child of 'node' (the root if -1), and where redo goes from it */
+static int *children_of(struct undo_state *undo, int node) {
+    return node < 0 ? &undo->root_first : &undo->nodes[node].first_child;
+}
+
+static int *redo_of(struct undo_state *undo, int node) {
+    return node < 0 ? &undo->root_redo : &undo->nodes[node].redo_child;
+}
+
+static int node_depth(const struct undo_state *undo, int node) {
+    return node < 0 ? 0 : undo->nodes[node].depth - undo->depth_base;
+}
+
+static int node_seq(const struct undo_state *undo, int node) {
+    return node < 0 ? undo->root_seq : undo->node_base + node;
+}
+
+static void stack_push(struct undo_state *undo, int *n, int node) {
+    if (*n == undo->stack_cap) {
+        int cap = undo->stack_cap ? undo->stack_cap * 2 : 64;
+        int *stack = mem_realloc(MEM_TAG_UNDO, undo->stack, sizeof(int) * (size_t)cap);
+        if (stack == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->stack = stack;
+        undo->stack_cap = cap;
+    }
+    undo->stack[(*n)++] = node;
+}
+
+/* A new group, child of the current state, which it becomes */
+static void node_new(struct undo_state *undo) {
+    close_group(undo);
+    if (undo->nnodes == undo->nodes_cap) {
+        int cap = undo->nodes_cap ? undo->nodes_cap * 2 : 64;
+        undo_node_t *nodes = mem_realloc(MEM_TAG_UNDO, undo->nodes,
+                                         sizeof(undo_node_t) * (size_t)cap);
+        if (nodes == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->nodes = nodes;
+        undo->nodes_cap = cap;
+    }
+    int slot = undo->nnodes++;
+    int parent = undo->cur;
+    undo_node_t *node = &undo->nodes[slot];
+    node->parent = parent;
+    node->first_child = node->redo_child = -1;
+    node->next_sibling = *children_of(undo, parent);
+    *children_of(undo, parent) = slot;
+    *redo_of(undo, parent) = slot;
+    node->first = undo->nentries;
+    node->count = 0;
+    node->depth = parent < 0 ? undo->depth_base + 1 : undo->nodes[parent].depth + 1;
+    node->path = parent < 0 ? undo->path_base : undo->nodes[parent].path;
+    node->time = time(NULL);
+    node->live = 1;
+    node->record = -1;
+    node->pack = NULL;
+    undo->live_nodes++;
+    undo->memory_used += sizeof(undo_node_t);
+
+    if (parent < 0) undo->cur_top = slot;
+    undo->cur = undo->open = slot;
+}
+
+/* Give up the pack of 'node' */
+static void pack_release(struct undo_state *undo, undo_node_t *n) {
+    arena_free(undo->arena, n->pack, n->pack_cap);
+    undo->memory_used -= (size_t)n->pack_cap;
+    undo->text_used -= (size_t)n->pack_text;
+    undo->packed_entries -= n->count;
+    n->pack = NULL;
+}
+
+/* Drop the entries of 'node' */
+static void node_release(struct undo_state *undo, int node) {
+    undo_node_t *n = &undo->nodes[node];
+    if (n->pack) {
+        pack_release(undo, n);
+    } else {
+        for (int i = 0; i < n->count; i++)
+            free_entry_data(&undo->entries[n->first + i], undo);
+    }
+    undo->live_entries -= n->count;
+    undo->memory_used -= sizeof(undo_node_t);
+    n->count = 0;
+    n->live = 0;
+    undo->live_nodes--;
+}
+
+/* Drop 'node' and every group below it */
+static void subtree_release(struct undo_state *undo, int node) {
+    int n = 0;
+    stack_push(undo, &n, node);
+    while (n > 0) {
+        int top = undo->stack[--n];
+        for (int c = undo->nodes[top].first_child; c >= 0;
+             c = undo->nodes[c].next_sibling)
+            stack_push(undo, &n, c);
+        node_release(undo, top);
+    }
+}
+
+/* Close the gaps dropped and packed groups leave in both arrays.
+ * Unpacked slices are out of slot order, so the entries are copied to a
+ * new array rather than moved down in place. */
+static void compact(struct undo_state *undo) {
+    int slots = undo->live_entries - undo->packed_entries;
+    int dead = undo->nentries - slots;
+    if (dead > UNDO_COMPACT_MIN && dead > slots) {
+        undo_entry_t *entries = mem_malloc(MEM_TAG_UNDO, sizeof(undo_entry_t) *
+                                                      (size_t)undo->entries_cap);
+        if (entries == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        int k = 0;
+        for (int i = undo->node_head; i < undo->nnodes; i++) {
+            undo_node_t *n = &undo->nodes[i];
+            if (!n->live || n->pack) continue;
+            memcpy(entries + k, undo->entries + n->first,
+                   sizeof(undo_entry_t) * (size_t)n->count);
+            n->first = k;
+            k += n->count;
+        }
+        mem_free(MEM_TAG_UNDO, undo->entries);
+        undo->entries = entries;
+        undo->nentries = k;
+    }
+
+    while (undo->node_head < undo->nnodes && !undo->nodes[undo->node_head].live)
+        undo->node_head++;
+    int shift = undo->node_head;
+    if (shift <= UNDO_COMPACT_MIN || shift <= undo->nnodes / 2) return;
+
+    undo->nnodes -= shift;
+    memmove(undo->nodes, undo->nodes + shift, sizeof(undo_node_t) * (size_t)undo->nnodes);
+    for (int i = 0; i < undo->nnodes; i++) {
+        undo_node_t *n = &undo->nodes[i];
+        if (!n->live) continue;
+        if (n->parent >= 0) n->parent -= shift;
+        if (n->first_child >= 0) n->first_child -= shift;
+        if (n->next_sibling >= 0) n->next_sibling -= shift;
+        if (n->redo_child >= 0) n->redo_child -= shift;
+    }
+    int *links[] = { &undo->root_first, &undo->root_redo, &undo->cur,
+                     &undo->cur_top, &undo->open };
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++)
+        if (*links[i] >= 0) *links[i] -= shift;
+    undo->node_head = 0;
+    undo->node_base += shift;
+    undo->pack_from = undo->pack_from > shift ? undo->pack_from - shift : 0;
+}
+
+/* Drop the oldest group. When the current state comes after it, it
+ * becomes the root and the other branches from the root go; otherwise
+ * it goes with its branch. */
+static void evict_oldest(struct undo_state *undo) {
+    int oldest = undo->node_head;
+    while (!undo->nodes[oldest].live) oldest++;
+    undo_node_t *n = &undo->nodes[oldest];
+
+    if (oldest == undo->cur_top) {
+        for (int c = undo->root_first, next; c >= 0; c = next) {
+            next = undo->nodes[c].next_sibling;
+            if (c != oldest) subtree_release(undo, c);
+        }
+        if (undo->cur == oldest) {
+            undo->cur_top = -1;
+        } else {
+            int top = undo->cur;
+            while (undo->nodes[top].parent != oldest) top = undo->nodes[top].parent;
+            undo->cur_top = top;
+        }
+        undo->root_first = n->first_child;
+        undo->root_redo = n->redo_child;
+        for (int c = n->first_child; c >= 0; c = undo->nodes[c].next_sibling)
+            undo->nodes[c].parent = -1;
+        undo->depth_base++;
+        undo->path_base += n->count;
+        undo->root_seq = node_seq(undo, oldest);
+        undo->root_time = n->time;
+        undo->root_record = n->record;
+        /* The history the file was opened with no longer leads here */
+        undo->opened_record = -1;
+        if (undo->journal) undo_journal_unmap(undo->journal);
+        if (undo->cur == oldest) undo->cur = -1;
+        node_release(undo, oldest);
+    } else {
+        int *link = &undo->root_first;
+        while (*link != oldest) link = &undo->nodes[*link].next_sibling;
+        *link = n->next_sibling;
+        if (undo->root_redo == oldest) undo->root_redo = undo->root_first;
+        subtree_release(undo, oldest);
+    }
+    compact(undo);
+}
+
+/* ======================== Packing ======================== */
+
+/* Room for 'need' more entries */
+static void entries_reserve(struct undo_state *undo, int need) {
+    if (undo->nentries + need <= undo->entries_cap) return;
+    int cap = undo->entries_cap ? undo->entries_cap * 2 : 64;
+    while (cap < undo->nentries + need) cap *= 2;
+    undo_entry_t *entries = mem_realloc(MEM_TAG_UNDO, undo->entries,
+                                        sizeof(undo_entry_t) * (size_t)cap);
+    if (entries == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    undo->entries = entries;
+    undo->entries_cap = cap;
+}
+
+/* Pack the entries of closed group 'node' into one compressed block, if
+ * that holds fewer bytes than they do. Groups with row contents shared
+ * with the buffer stay as they are: packing would copy them. Returns
+ * whether it was packed. */
+static int pack_node(struct undo_state *undo, int node) {
+    undo_node_t *n = &undo->nodes[node];
+    size_t held = 0, text = 0;
+    for (int i = 0; i < n->count; i++) {
+        const undo_entry_t *e = &undo->entries[n->first + i];
+        if (e->type == UNDO_REPLACE_ROWS && e->data.rows_op->old_share) return 0;
+        held += entry_size(e);
+        text += entry_text(e);
+    }
+    node_serialize(undo, node);
+    if (undo->jlen > INT_MAX || text > INT_MAX) return 0;
+
+    size_t bound = lz_bound(undo->jlen);
+    if (bound > undo->zcap) {
+        char *buf = mem_realloc(MEM_TAG_UNDO, undo->zbuf, bound);
+        if (buf == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->zbuf = buf;
+        undo->zcap = bound;
+    }
+    size_t len = lz_compress(undo->jbuf, undo->jlen, undo->zbuf);
+    if (len >= held || len > INT_MAX) return 0;
+    int cap;
+    char *pack = text_alloc(undo, len, &cap);
+    if ((size_t)cap >= held) {
+        arena_free(undo->arena, pack, cap);
+        return 0;
+    }
+    memcpy(pack, undo->zbuf, len);
+
+    for (int i = 0; i < n->count; i++)
+        free_entry_data(&undo->entries[n->first + i], undo);
+    n->pack = pack;
+    n->pack_cap = cap;
+    n->pack_len = (int)len;
+    n->raw_len = (int)undo->jlen;
+    n->pack_text = (int)text;
+    n->first = -1;
+    undo->packed_entries += n->count;
+    undo->memory_used += (size_t)cap;
+    undo->text_used += text;
+    return 1;
+}
+
+/* Pack the oldest group that packing shrinks. Returns whether one was. */
+static int pack_oldest(struct undo_state *undo) {
+    int settled = 1;    /* Every node so far is dead, packed or stays so */
+    int from = undo->pack_from > undo->node_head ? undo->pack_from : undo->node_head;
+    for (int i = from; i < undo->nnodes; i++) {
+        const undo_node_t *n = &undo->nodes[i];
+        int open = i == undo->open;
+        int packed = n->live && !n->pack && !open && n->count > 0 &&
+                     pack_node(undo, i);
+        if (open) settled = 0;
+        if (settled) undo->pack_from = i + 1;
+        if (packed) return 1;
+    }
+    return 0;
+}
+
+/* Unpack the entries of 'node' into a slice at the end of the array.
+ * The open group is closed first: it must stay the last slice.
+ * Returns 0, or -1 if the pack doesn't decode (it then stays packed). */
+static int unpack_node(struct undo_state *undo, int node) {
+    undo_node_t *n = &undo->nodes[node];
+    if (!n->pack) return 0;
+    close_group(undo);
+
+    entries_reserve(undo, n->count);
+    undo_entry_t *got = undo->entries + undo->nentries;
+    int done = 0;
+    if (node_serialize(undo, node) == 0) {
+        entry_reader r = { undo->jbuf, undo->jbuf + undo->jlen };
+        while (done < n->count && decode_entry(undo, &r, &got[done]) == 0)
+            entry_held(undo, &got[done++]);
+    }
+    if (done < n->count) {
+        while (done > 0) free_entry_data(&got[--done], undo);
+        return -1;
+    }
+
+    pack_release(undo, n);
+    n->first = undo->nentries;
+    undo->nentries += n->count;
+    if (node < undo->pack_from) undo->pack_from = node;
+    return 0;
+}
+
+/* Bring the history within its limits: pack old groups while the bytes
+ * are over, then drop the oldest. The group being added to stays,
+ * however large. */
+static void trim(struct undo_state *undo) {
+    while ((undo->live_entries > undo->capacity ||
+            undo->memory_used > undo->memory_limit) &&
+           undo->live_nodes > 1) {
+        if (undo->live_entries <= undo->capacity && pack_oldest(undo)) continue;
+        evict_oldest(undo);
+    }
+}
+
 /* ======================== Grouping Logic ======================== */
 
 /* Should we start a new undo group for this operation? */
 static int should_break_group(struct undo_state *undo, undo_op_type_t op,
                                int row, int col) {
-    if (undo->current_group_id == 0) return 1;  /* First operation */
+    /* First operation, after a break, or after moving in the tree */
+    if (undo->open < 0 || undo->open != undo->cur) return 1;
+    if (undo->held) return 0;
 
     /* Time gap check */
     time_t now = time(NULL);
@@ -104,11 +917,12 @@ static int should_break_group(struct undo_state *undo, undo_op_type_t op,
     }
 
     /* Operation type change (insert→delete or vice versa) */
-    if (undo->last_op == UNDO_INSERT_CHAR && op == UNDO_DELETE_CHAR) return 1;
-    if (undo->last_op == UNDO_DELETE_CHAR && op == UNDO_INSERT_CHAR) return 1;
+    if (undo->last_op == UNDO_INSERT_TEXT && op == UNDO_DELETE_TEXT) return 1;
+    if (undo->last_op == UNDO_DELETE_TEXT && op == UNDO_INSERT_TEXT) return 1;
 
     /* Line operations always break groups */
     if (op == UNDO_INSERT_LINE || op == UNDO_DELETE_LINE) return 1;
+    if (op == UNDO_REPLACE_ROWS || op == UNDO_REPLACE_RANGE) return 1;
 
     /* Cursor jumped (user moved cursor manually) */
     if (undo->last_edit_row != row) return 1;
@@ -123,116 +937,311 @@ void undo_break_group(editor_ctx_t *ctx) {
     if (!ctx->model.undo_state) return;
 
     struct undo_state *undo = ctx->model.undo_state;
-    if (undo->count > 0) {
-        int last_idx = (undo->head - 1 + undo->capacity) % undo->capacity;
-        undo->entries[last_idx].group_break = 1;
-    }
-    undo->current_group_id = 0;  /* Force new group on next operation */
+    if (undo->held) return;
+    close_group(undo);  /* Force new group on next operation */
 }
 
-/* ======================== Recording Operations ======================== */
+void undo_hold_group(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+    if (undo->held++ == 0) close_group(undo);
+}
 
-static void free_entry_data(undo_entry_t *entry, struct undo_state *undo) {
-    if ((entry->type == UNDO_INSERT_LINE || entry->type == UNDO_DELETE_LINE) &&
-        entry->data.line_op.content) {
-        undo->memory_used -= entry->data.line_op.length;
-        free(entry->data.line_op.content);
-        entry->data.line_op.content = NULL;
-    }
+void undo_release_group(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || undo->held == 0) return;
+    if (--undo->held == 0) close_group(undo);
 }
 
+/* ======================== Recording Operations ======================== */
+
 static void record_operation(editor_ctx_t *ctx, undo_entry_t *entry) {
     struct undo_state *undo = ctx->model.undo_state;
     if (!undo) return;
+    journal_start(undo);
 
-    /* Check if we should start new group */
+    /* Check if we should start new group. A new group after an undo is a
+     * new branch; the undone groups stay in the tree. */
     if (should_break_group(undo, entry->type, entry->row, entry->col)) {
-        undo->current_group_id = undo->next_group_id++;
+        node_new(undo);
     }
 
-    entry->group_id = undo->current_group_id;
-    entry->group_break = 0;
-
     /* Update grouping heuristics */
     undo->last_edit_time = time(NULL);
     undo->last_edit_row = entry->row;
     undo->last_edit_col = entry->col;
     undo->last_op = entry->type;
 
-    /* If we've undone operations, discard redo history */
-    if (undo->current < undo->count) {
-        /* Free any line content in discarded entries */
-        for (int i = undo->current; i < undo->count; i++) {
-            int idx = (undo->head - undo->count + i + undo->capacity) % undo->capacity;
-            free_entry_data(&undo->entries[idx], undo);
-        }
-        undo->count = undo->current;
-    }
+    /* Write entry at the end of the open group's slice */
+    entries_reserve(undo, 1);
+    undo->entries[undo->nentries++] = *entry;
+    undo_node_t *node = &undo->nodes[undo->open];
+    node->count++;
+    node->path++;
+    node->time = undo->last_edit_time;
+    undo->live_entries++;
+    entry_held(undo, entry);
+
+    trim(undo);
+}
+
+/* The newest entry, when a character inserted ('op' UNDO_INSERT_TEXT) or
+ * deleted at 'row', 'col' continues its text run: same group, at the end
+ * of the branch, and next to the run. */
+static undo_entry_t *run_to_extend(struct undo_state *undo, undo_op_type_t op,
+                                   int row, int col) {
+    if (should_break_group(undo, op, row, col)) return NULL;
+    if (undo->nodes[undo->open].count == 0) return NULL;
+
+    undo_entry_t *e = &undo->entries[undo->nentries - 1];
+    if (e->type != op || e->row != row) return NULL;
+    if (op == UNDO_INSERT_TEXT)
+        return col == e->col + e->data.text_op.length ? e : NULL;
+    /* Forward delete at the run's start, or backspace just before it */
+    return col == e->col || col == e->col - 1 ? e : NULL;
+}
 
-    /* Add entry to circular buffer */
-    if (undo->count == undo->capacity) {
-        /* Buffer full - evict oldest entry */
-        int evict_idx = undo->head;
-        free_entry_data(&undo->entries[evict_idx], undo);
+/* Add 'ch' to the end of a text run, or its start if 'front' */
+static void run_add(struct undo_state *undo, undo_entry_t *e, char ch,
+                    int front) {
+    int len = e->data.text_op.length;
+    if (len == e->data.text_op.cap) {
+        int cap;
+        char *text = text_alloc(undo, len ? (size_t)len * 2 : 16, &cap);
+        if (len) memcpy(text, e->data.text_op.text, (size_t)len);
+        arena_free(undo->arena, e->data.text_op.text, e->data.text_op.cap);
+        undo->memory_used += (size_t)(cap - e->data.text_op.cap);
+        e->data.text_op.text = text;
+        e->data.text_op.cap = cap;
+    }
+    char *text = e->data.text_op.text;
+    if (front) {
+        memmove(text + 1, text, (size_t)len);
+        text[0] = ch;
     } else {
-        undo->count++;
+        text[len] = ch;
     }
+    e->data.text_op.length++;
+    undo->text_used++;
+}
 
-    /* Write entry */
-    undo->entries[undo->head] = *entry;
-    undo->head = (undo->head + 1) % undo->capacity;
-    undo->current = undo->count;
+/* Record one character inserted or deleted, extending a run if it can */
+static void record_text(editor_ctx_t *ctx, undo_op_type_t op, int row,
+                        int col, char ch) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
 
-    /* Track memory for line operations */
-    if (entry->type == UNDO_INSERT_LINE || entry->type == UNDO_DELETE_LINE) {
-        undo->memory_used += entry->data.line_op.length;
+    undo_entry_t *run = run_to_extend(undo, op, row, col);
+    if (run) {
+        int front = op == UNDO_DELETE_TEXT && col < run->col;
+        if (front) run->col = col;
+        run_add(undo, run, ch, front);
+        undo->last_edit_time = time(NULL);
+        undo->last_edit_col = col;
+        undo->nodes[undo->open].time = undo->last_edit_time;
+        trim(undo);
+        return;
     }
-}
-
-void undo_record_insert_char(editor_ctx_t *ctx, int row, int col, char ch) {
-    if (!ctx->model.undo_state) return;
 
     undo_entry_t entry = {
-        .type = UNDO_INSERT_CHAR,
+        .type = op,
         .row = row,
         .col = col,
-        .data.char_op.ch = ch,
         .cursor_row = ctx->view.cy,
         .cursor_col = ctx->view.cx,
         .cursor_rowoff = ctx->view.rowoff,
         .cursor_coloff = ctx->view.coloff
     };
-
     record_operation(ctx, &entry);
+    run_add(undo, &undo->entries[undo->nentries - 1], ch, 0);
+}
+
+void undo_record_insert_char(editor_ctx_t *ctx, int row, int col, char ch) {
+    record_text(ctx, UNDO_INSERT_TEXT, row, col, ch);
 }
 
 void undo_record_delete_char(editor_ctx_t *ctx, int row, int col, char ch) {
-    if (!ctx->model.undo_state) return;
+    record_text(ctx, UNDO_DELETE_TEXT, row, col, ch);
+}
+
+static void record_line(editor_ctx_t *ctx, undo_op_type_t op, int row,
+                        int col, const char *content, int length) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
 
     undo_entry_t entry = {
-        .type = UNDO_DELETE_CHAR,
+        .type = op,
         .row = row,
         .col = col,
-        .data.char_op.ch = ch,
+        .data.line_op.length = length,
         .cursor_row = ctx->view.cy,
         .cursor_col = ctx->view.cx,
         .cursor_rowoff = ctx->view.rowoff,
         .cursor_coloff = ctx->view.coloff
     };
+    entry.data.line_op.content = text_copy(undo, content, length,
+                                           &entry.data.line_op.cap);
 
     record_operation(ctx, &entry);
 }
 
 void undo_record_insert_line(editor_ctx_t *ctx, int row, int col,
                               const char *content, int length) {
-    if (!ctx->model.undo_state) return;
+    record_line(ctx, UNDO_INSERT_LINE, row, col, content, length);
+}
+
+void undo_record_delete_line(editor_ctx_t *ctx, int row, int col,
+                              const char *content, int length) {
+    record_line(ctx, UNDO_DELETE_LINE, row, col, content, length);
+}
+
+/* Grow one of the content arrays of 'rows' to hold 'need' more bytes */
+static char *rows_text_reserve(char *text, size_t *cap, size_t size,
+                               size_t need) {
+    if (size + need <= *cap) return text;
+    size_t cap2 = *cap ? *cap * 2 : 4096;
+    while (cap2 < size + need) cap2 *= 2;
+    text = realloc(text, cap2);
+    if (text == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *cap = cap2;
+    return text;
+}
+
+/* Grow a list of shares to 'cap', the new slots NULL */
+static struct RowShare **rows_share_reserve(struct RowShare **share,
+                                            int old_cap, int cap) {
+    share = realloc(share, sizeof(*share) * (size_t)cap);
+    if (share == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memset(share + old_cap, 0, sizeof(*share) * (size_t)(cap - old_cap));
+    return share;
+}
+
+/* Make room for one more row */
+static void rows_reserve(undo_rows_t *rows) {
+    if (rows->count < rows->cap) return;
+    int cap = rows->cap ? rows->cap * 2 : 64;
+    int *r = realloc(rows->row, sizeof(int) * (size_t)cap);
+    int *o = r ? realloc(rows->old_len, sizeof(int) * (size_t)cap) : NULL;
+    int *n = o ? realloc(rows->new_len, sizeof(int) * (size_t)cap) : NULL;
+    if (n == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    rows->row = r;
+    rows->old_len = o;
+    rows->new_len = n;
+    if (rows->old_share) {
+        rows->old_share = rows_share_reserve(rows->old_share, rows->cap, cap);
+        rows->new_share = rows_share_reserve(rows->new_share, rows->cap, cap);
+    }
+    rows->cap = cap;
+}
+
+void undo_rows_add(undo_rows_t *rows, int row, const char *old_text,
+                   int old_len, const char *new_text, int new_len) {
+    rows_reserve(rows);
+    rows->old_text = rows_text_reserve(rows->old_text, &rows->old_cap,
+                                       rows->old_size, (size_t)old_len);
+    rows->new_text = rows_text_reserve(rows->new_text, &rows->new_cap,
+                                       rows->new_size, (size_t)new_len);
+    memcpy(rows->old_text + rows->old_size, old_text, (size_t)old_len);
+    memcpy(rows->new_text + rows->new_size, new_text, (size_t)new_len);
+    rows->old_size += (size_t)old_len;
+    rows->new_size += (size_t)new_len;
+    rows->row[rows->count] = row;
+    rows->old_len[rows->count] = old_len;
+    rows->new_len[rows->count] = new_len;
+    rows->count++;
+}
+
+void undo_rows_set(undo_rows_t *rows, editor_ctx_t *ctx, int row,
+                   const char *new_text, int new_len) {
+    t_erow *er = editor_row(ctx, row);
+    if (!er) return;
+    rows_reserve(rows);
+    if (!rows->old_share) {
+        rows->old_share = rows_share_reserve(NULL, 0, rows->cap);
+        rows->new_share = rows_share_reserve(NULL, 0, rows->cap);
+    }
+
+    RowShare *old = editor_row_share(&ctx->model, er);
+    editor_row_set(ctx, er, new_text, (size_t)new_len);
+    RowShare *new = editor_row_share(&ctx->model, er);
+
+    rows->row[rows->count] = row;
+    rows->old_len[rows->count] = old->len;
+    rows->new_len[rows->count] = new->len;
+    rows->old_share[rows->count] = old;
+    rows->new_share[rows->count] = new;
+    rows->shared_size += (size_t)old->len + (size_t)new->len;
+    rows->count++;
+}
+
+/* Resize a block down to 'size' bytes (at least one, so it stays) */
+static void *shrink_block(void *p, size_t size) {
+    if (p == NULL) return NULL;
+    void *q = realloc(p, size ? size : 1);
+    return q ? q : p;
+}
+
+/* Give back the room a finished list of rows grew into */
+static void rows_shrink(undo_rows_t *rows) {
+    size_t n = (size_t)rows->count;
+    rows->row = shrink_block(rows->row, sizeof(int) * n);
+    rows->old_len = shrink_block(rows->old_len, sizeof(int) * n);
+    rows->new_len = shrink_block(rows->new_len, sizeof(int) * n);
+    if (rows->old_share) {
+        rows->old_share = shrink_block(rows->old_share, sizeof(*rows->old_share) * n);
+        rows->new_share = shrink_block(rows->new_share, sizeof(*rows->new_share) * n);
+    }
+    rows->old_text = shrink_block(rows->old_text, rows->old_size);
+    rows->new_text = shrink_block(rows->new_text, rows->new_size);
+    rows->cap = rows->count;
+    rows->old_cap = rows->old_text ? (rows->old_size ? rows->old_size : 1) : 0;
+    rows->new_cap = rows->new_text ? (rows->new_size ? rows->new_size : 1) : 0;
+}
+
+void undo_rows_free(undo_rows_t *rows) {
+    for (int i = 0; rows->old_share && i < rows->count; i++) {
+        editor_row_share_release(rows->old_share[i]);
+        editor_row_share_release(rows->new_share[i]);
+    }
+    free(rows->old_share);
+    free(rows->new_share);
+    free(rows->row);
+    free(rows->old_len);
+    free(rows->new_len);
+    free(rows->old_text);
+    free(rows->new_text);
+    memset(rows, 0, sizeof(*rows));
+}
+
+void undo_record_replace_rows(editor_ctx_t *ctx, undo_rows_t *rows) {
+    if (!ctx->model.undo_state || rows->count == 0) {
+        undo_rows_free(rows);
+        return;
+    }
+
+    undo_rows_t *held = malloc(sizeof(undo_rows_t));
+    if (held == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    *held = *rows;
+    memset(rows, 0, sizeof(*rows));
+    rows_shrink(held);
 
     undo_entry_t entry = {
-        .type = UNDO_INSERT_LINE,
-        .row = row,
-        .col = col,
-        .data.line_op.content = strndup(content, length),
-        .data.line_op.length = length,
+        .type = UNDO_REPLACE_ROWS,
+        .row = held->row[0],
+        .col = 0,
+        .data.rows_op = held,
         .cursor_row = ctx->view.cy,
         .cursor_col = ctx->view.cx,
         .cursor_rowoff = ctx->view.rowoff,
@@ -240,18 +1249,29 @@ void undo_record_insert_line(editor_ctx_t *ctx, int row, int col,
     };
 
     record_operation(ctx, &entry);
+    undo_break_group(ctx);
 }
 
-void undo_record_delete_line(editor_ctx_t *ctx, int row, int col,
-                              const char *content, int length) {
-    if (!ctx->model.undo_state) return;
+void undo_record_replace_range(editor_ctx_t *ctx, int row, int col,
+                               const char *old_text, int old_len,
+                               const char *new_text, int new_len) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+
+    int cap;
+    char *text = text_alloc(undo, (size_t)old_len + (size_t)new_len + 1, &cap);
+    memcpy(text, old_text, (size_t)old_len);
+    memcpy(text + old_len, new_text, (size_t)new_len);
+    text[old_len + new_len] = '\0';
 
     undo_entry_t entry = {
-        .type = UNDO_DELETE_LINE,
+        .type = UNDO_REPLACE_RANGE,
         .row = row,
         .col = col,
-        .data.line_op.content = strndup(content, length),
-        .data.line_op.length = length,
+        .data.range_op.text = text,
+        .data.range_op.old_len = old_len,
+        .data.range_op.new_len = new_len,
+        .data.range_op.cap = cap,
         .cursor_row = ctx->view.cy,
         .cursor_col = ctx->view.cx,
         .cursor_rowoff = ctx->view.rowoff,
@@ -259,53 +1279,131 @@ void undo_record_delete_line(editor_ctx_t *ctx, int row, int col,
     };
 
     record_operation(ctx, &entry);
+    undo_break_group(ctx);
 }
 
 /* ======================== Undo/Redo Operations ======================== */
 
+/* Put back the old (or the new) contents of the rows of a REPLACE_ROWS */
+static void apply_rows(editor_ctx_t *ctx, const undo_rows_t *rows, int old) {
+    const char *text = old ? rows->old_text : rows->new_text;
+    RowShare **share = old ? rows->old_share : rows->new_share;
+    const int *len = old ? rows->old_len : rows->new_len;
+    size_t at = 0;
+
+    for (int i = 0; i < rows->count; i++) {
+        t_erow *row = editor_row(ctx, rows->row[i]);
+        if (share && share[i]) {
+            if (row) editor_row_set_shared(ctx, row, share[i]);
+            continue;
+        }
+        if (row) editor_row_set(ctx, row, text + at, (size_t)len[i]);
+        at += (size_t)len[i];
+    }
+}
+
+/* Where 'len' bytes of 'text' put at (row, col) end */
+static void text_end(int row, int col, const char *text, int len,
+                     int *end_row, int *end_col) {
+    *end_row = row;
+    *end_col = col;
+    for (int i = 0; i < len; i++) {
+        if (text[i] == '\n') {
+            (*end_row)++;
+            *end_col = 0;
+        } else {
+            (*end_col)++;
+        }
+    }
+}
+
+/* Replace the old text of a REPLACE_RANGE entry by its new text, or the
+ * new by the old when undoing */
+static void apply_range(editor_ctx_t *ctx, const undo_entry_t *entry,
+                        int undo) {
+    const char *removed = entry->data.range_op.text;
+    const char *put = removed + entry->data.range_op.old_len;
+    int removed_len = entry->data.range_op.old_len;
+    int put_len = entry->data.range_op.new_len;
+    if (undo) {
+        const char *t = removed; removed = put; put = t;
+        int n = removed_len; removed_len = put_len; put_len = n;
+    }
+    int end_row, end_col;
+    text_end(entry->row, entry->col, removed, removed_len, &end_row, &end_col);
+    editor_replace_range(ctx, entry->row, entry->col, end_row, end_col,
+                         put, (size_t)put_len, NULL, NULL);
+}
+
+/* Rewrite row 'at' with the 'del' bytes from 'col' replaced by the 'len'
+ * bytes at 'text', clamped to the row */
+static void splice_row(editor_ctx_t *ctx, int at, int col, int del,
+                       const char *text, int len) {
+    t_erow *row = editor_row(ctx, at);
+    if (!row) return;
+    if (col < 0) col = 0;
+    if (col > row->size) col = row->size;
+    if (del > row->size - col) del = row->size - col;
+
+    size_t size = (size_t)(row->size - del + len);
+    char *buf = malloc(size + 1);
+    if (buf == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(buf, row->chars, (size_t)col);
+    memcpy(buf + col, text, (size_t)len);
+    memcpy(buf + col + len, row->chars + col + del, (size_t)(row->size - col - del));
+    editor_row_set(ctx, row, buf, size);
+    free(buf);
+}
+
 /* Apply single undo operation (reverse the operation) */
 static void apply_undo(editor_ctx_t *ctx, undo_entry_t *entry) {
     /* Suppress undo recording while applying undo */
     struct undo_state *saved_state = ctx->model.undo_state;
     ctx->model.undo_state = NULL;
 
-    t_erow *row;
-
     switch (entry->type) {
-        case UNDO_INSERT_CHAR:
-            /* Undo insert = delete the character */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
-                row = &ctx->model.row[entry->row];
-                if (entry->col >= 0 && entry->col < row->size) {
-                    editor_row_del_char(ctx, row, entry->col);
-                }
-            }
+        case UNDO_INSERT_TEXT:
+            /* Undo insert = delete the run */
+            splice_row(ctx, entry->row, entry->col, entry->data.text_op.length,
+                       "", 0);
             break;
 
-        case UNDO_DELETE_CHAR:
-            /* Undo delete = re-insert the character */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
-                row = &ctx->model.row[entry->row];
-                editor_row_insert_char(ctx, row, entry->col, entry->data.char_op.ch);
-            }
+        case UNDO_DELETE_TEXT:
+            /* Undo delete = re-insert the run */
+            splice_row(ctx, entry->row, entry->col, 0, entry->data.text_op.text,
+                       entry->data.text_op.length);
             break;
 
         case UNDO_INSERT_LINE:
             /* Undo line insert = delete the line (merge with previous) */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
-                /* Delete the newline that was inserted */
+            if (entry->row >= 0 && entry->row + 1 < editor_numrows(ctx)) {
+                splice_row(ctx, entry->row, entry->col, 0, entry->data.line_op.content,
+                           entry->data.line_op.length);
                 editor_del_row(ctx, entry->row + 1);
             }
             break;
 
         case UNDO_DELETE_LINE:
             /* Undo line delete = re-insert the line (split) */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
+            if (entry->row >= 0 && entry->row < editor_numrows(ctx)) {
                 editor_insert_row(ctx, entry->row + 1,
                                  entry->data.line_op.content,
                                  entry->data.line_op.length);
+                splice_row(ctx, entry->row, entry->col, entry->data.line_op.length,
+                           "", 0);
             }
             break;
+
+        case UNDO_REPLACE_ROWS:
+            apply_rows(ctx, entry->data.rows_op, 1);
+            break;
+
+        case UNDO_REPLACE_RANGE:
+            apply_range(ctx, entry, 1);
+            break;
     }
 
     /* Restore cursor position from before the operation */
@@ -324,121 +1422,229 @@ static void apply_redo(editor_ctx_t *ctx, undo_entry_t *entry) {
     struct undo_state *saved_state = ctx->model.undo_state;
     ctx->model.undo_state = NULL;
 
-    t_erow *row;
-
     switch (entry->type) {
-        case UNDO_INSERT_CHAR:
-            /* Redo insert = insert the character again */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
-                row = &ctx->model.row[entry->row];
-                editor_row_insert_char(ctx, row, entry->col, entry->data.char_op.ch);
-            }
+        case UNDO_INSERT_TEXT:
+            /* Redo insert = insert the run again */
+            splice_row(ctx, entry->row, entry->col, 0, entry->data.text_op.text,
+                       entry->data.text_op.length);
             break;
 
-        case UNDO_DELETE_CHAR:
-            /* Redo delete = delete the character again */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
-                row = &ctx->model.row[entry->row];
-                if (entry->col >= 0 && entry->col < row->size) {
-                    editor_row_del_char(ctx, row, entry->col);
-                }
-            }
+        case UNDO_DELETE_TEXT:
+            /* Redo delete = delete the run again */
+            splice_row(ctx, entry->row, entry->col, entry->data.text_op.length,
+                       "", 0);
             break;
 
         case UNDO_INSERT_LINE:
             /* Redo line insert = split line again */
-            if (entry->row >= 0 && entry->row < ctx->model.numrows) {
+            if (entry->row >= 0 && entry->row < editor_numrows(ctx)) {
                 editor_insert_row(ctx, entry->row + 1,
                                  entry->data.line_op.content,
                                  entry->data.line_op.length);
+                splice_row(ctx, entry->row, entry->col, entry->data.line_op.length,
+                           "", 0);
             }
             break;
 
         case UNDO_DELETE_LINE:
             /* Redo line delete = merge lines again */
-            if (entry->row >= 0 && entry->row + 1 < ctx->model.numrows) {
+            if (entry->row >= 0 && entry->row + 1 < editor_numrows(ctx)) {
+                splice_row(ctx, entry->row, entry->col, 0, entry->data.line_op.content,
+                           entry->data.line_op.length);
                 editor_del_row(ctx, entry->row + 1);
             }
             break;
+
+        case UNDO_REPLACE_ROWS:
+            apply_rows(ctx, entry->data.rows_op, 0);
+            break;
+
+        case UNDO_REPLACE_RANGE:
+            apply_range(ctx, entry, 0);
+            break;
     }
 
     /* Restore undo state */
     ctx->model.undo_state = saved_state;
 }
+/* Say a group could not be read back: the buffer stays as it is */
+static int unreadable(editor_ctx_t *ctx) {
+    editor_set_status_msg(ctx, "Can't undo or redo: undo history corrupted");
+    return -1;
+}
+
+/* Undo group 'node', going to its parent state. Returns 0, or -1 if its
+ * entries can't be read back (nothing is then undone). */
+static int node_undo(editor_ctx_t *ctx, struct undo_state *undo, int node) {
+    if (node == undo->open) close_group(undo);  /* Recorded before undone */
+    if (unpack_node(undo, node) == -1) return unreadable(ctx);
+    record_node(undo, UNDO_RECORD_UNDO, node);
+    undo_node_t *n = &undo->nodes[node];
+    for (int i = n->count - 1; i >= 0; i--)
+        apply_undo(ctx, &undo->entries[n->first + i]);
+    *redo_of(undo, n->parent) = node;
+    if (n->parent < 0) undo->cur_top = -1;
+    undo->cur = n->parent;
+    return 0;
+}
+
+/* Redo group 'node', a child of the current state; as node_undo() */
+static int node_redo(editor_ctx_t *ctx, struct undo_state *undo, int node) {
+    if (unpack_node(undo, node) == -1) return unreadable(ctx);
+    record_node(undo, UNDO_RECORD_REDO, node);
+    undo_node_t *n = &undo->nodes[node];
+    for (int i = 0; i < n->count; i++)
+        apply_redo(ctx, &undo->entries[n->first + i]);
+    *redo_of(undo, n->parent) = node;
+    if (n->parent < 0) undo->cur_top = node;
+    undo->cur = node;
+    return 0;
+}
 
 int undo_perform(editor_ctx_t *ctx) {
     struct undo_state *undo = ctx->model.undo_state;
-    if (!undo || undo->current == 0) return 0;  /* Nothing to undo */
+    if (!undo || undo->held) return 0;  /* Not in the middle of a group */
+    journal_start(undo);
+    if (undo->cur < 0) import_history(undo);
+    if (undo->cur < 0) return 0;  /* Nothing to undo */
+
+    if (node_undo(ctx, undo, undo->cur) == -1) return -2;
+    close_group(undo);
+    ctx->model.dirty++;
+    return 1;
+}
+
+int redo_perform(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || undo->held) return 0;
+    int next = *redo_of(undo, undo->cur);
+    if (next < 0) return 0;  /* Nothing to redo */
 
-    /* Find start of current group */
-    int target_group = -1;
-    int undo_idx = undo->current - 1;
+    if (node_redo(ctx, undo, next) == -1) return -2;
+    close_group(undo);
+    ctx->model.dirty++;
+    return 1;
+}
 
-    for (int i = undo->current - 1; i >= 0; i--) {
-        int idx = (undo->head - undo->count + i + undo->capacity) % undo->capacity;
-        undo_entry_t *e = &undo->entries[idx];
+/* ======================== Moving in the Tree ======================== */
 
-        if (target_group == -1) {
-            target_group = e->group_id;
-        } else if (e->group_id != target_group || e->group_break) {
-            break;  /* Different group or explicit break, stop here */
-        }
-        undo_idx = i;
-    }
+/* Go from the current state to that of 'target' (-1 the root): undo up
+ * to the nearest common ancestor, then redo down to 'target'. A group
+ * that can't be read back stops it there, in the state reached: -2. */
+static int goto_node(editor_ctx_t *ctx, struct undo_state *undo, int target) {
+    if (target == undo->cur) return 0;
 
-    /* Undo all operations in this group (in reverse order) */
-    for (int i = undo->current - 1; i >= undo_idx; i--) {
-        int idx = (undo->head - undo->count + i + undo->capacity) % undo->capacity;
-        apply_undo(ctx, &undo->entries[idx]);
+    int from = undo->cur, a = from, b = target, n = 0, failed = 0;
+    while (node_depth(undo, b) > node_depth(undo, a)) {
+        stack_push(undo, &n, b);
+        b = undo->nodes[b].parent;
+    }
+    while (!failed && node_depth(undo, a) > node_depth(undo, b)) {
+        failed = node_undo(ctx, undo, a) == -1;
+        a = undo->cur;
+    }
+    while (!failed && a != b) {
+        failed = node_undo(ctx, undo, a) == -1;
+        a = undo->cur;
+        stack_push(undo, &n, b);
+        b = undo->nodes[b].parent;
     }
+    while (!failed && n > 0) failed = node_redo(ctx, undo, undo->stack[--n]) == -1;
 
-    undo->current = undo_idx;
-    ctx->model.dirty++;
-    return 1;
+    close_group(undo);
+    if (undo->cur != from) ctx->model.dirty++;
+    return failed ? -2 : 1;
 }
 
-int redo_perform(editor_ctx_t *ctx) {
-    struct undo_state *undo = ctx->model.undo_state;
-    if (!undo || undo->current >= undo->count) return 0;  /* Nothing to redo */
+/* The slot of group 'seq', -1 for the root state, or -2 if not kept */
+static int seq_node(const struct undo_state *undo, int seq) {
+    if (seq == undo->root_seq) return -1;
+    int slot = seq - undo->node_base;
+    if (slot < undo->node_head || slot >= undo->nnodes || !undo->nodes[slot].live)
+        return -2;
+    return slot;
+}
 
-    /* Find end of next group */
-    int idx = (undo->head - undo->count + undo->current + undo->capacity) % undo->capacity;
-    int target_group = undo->entries[idx].group_id;
-    int redo_end = undo->current;
+int undo_state_seq(editor_ctx_t *ctx, int *newest) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (undo) journal_start(undo);
+    if (newest) *newest = undo ? undo->node_base + undo->nnodes - 1 : 0;
+    if (!undo) return 0;
+    if (newest && *newest < undo->root_seq) *newest = undo->root_seq;
+    return node_seq(undo, undo->cur);
+}
 
-    for (int i = undo->current; i < undo->count; i++) {
-        idx = (undo->head - undo->count + i + undo->capacity) % undo->capacity;
-        undo_entry_t *e = &undo->entries[idx];
+time_t undo_state_time(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return 0;
+    journal_start(undo);
+    return undo->cur < 0 ? undo->root_time : undo->nodes[undo->cur].time;
+}
 
-        redo_end = i + 1;
+int undo_goto(editor_ctx_t *ctx, int seq) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || undo->held) return -1;
+    journal_start(undo);
+    if (seq < undo->root_seq) import_history(undo);
+    int target = seq_node(undo, seq);
+    if (target == -2) return -1;
+    return goto_node(ctx, undo, target);
+}
 
-        if (e->group_break || (i + 1 < undo->count &&
-            undo->entries[(undo->head - undo->count + i + 1 + undo->capacity) % undo->capacity].group_id != target_group)) {
-            break;  /* End of group */
+int undo_step(editor_ctx_t *ctx, int steps) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || steps == 0) return 0;
+    journal_start(undo);
+    if (steps < 0) import_history(undo);
+
+    /* States in the order made: the root, then the live slots */
+    int slot = undo->cur < 0 ? undo->node_head - 1 : undo->cur;
+    int dir = steps > 0 ? 1 : -1;
+    int target = undo->cur;
+    for (int left = steps * dir; left > 0; ) {
+        slot += dir;
+        if (slot < undo->node_head) {
+            target = -1;
+            break;
         }
+        if (slot >= undo->nnodes) break;
+        if (!undo->nodes[slot].live) continue;
+        target = slot;
+        left--;
     }
+    return goto_node(ctx, undo, target);
+}
 
-    /* Redo all operations in this group (in forward order) */
-    for (int i = undo->current; i < redo_end; i++) {
-        idx = (undo->head - undo->count + i + undo->capacity) % undo->capacity;
-        apply_redo(ctx, &undo->entries[idx]);
+int undo_goto_time(editor_ctx_t *ctx, time_t when) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || undo->held) return 0;
+    journal_start(undo);
+    if (when < undo->root_time) import_history(undo);
+
+    /* Times only grow from slot to slot, dropped ones included */
+    int lo = undo->node_head, hi = undo->nnodes;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (undo->nodes[mid].time <= when) lo = mid + 1;
+        else hi = mid;
     }
-
-    undo->current = redo_end;
-    ctx->model.dirty++;
-    return 1;
+    int target = lo - 1;
+    while (target >= undo->node_head && !undo->nodes[target].live) target--;
+    if (target < undo->node_head) target = -1;
+    return goto_node(ctx, undo, target);
 }
 
 /* ======================== Query Functions ======================== */
 
 int undo_can_undo(editor_ctx_t *ctx) {
     struct undo_state *undo = ctx->model.undo_state;
-    return undo && undo->current > 0;
+    if (undo) journal_start(undo);
+    return undo && (undo->cur >= 0 || undo->opened_record >= 0);
 }
 
 int undo_can_redo(editor_ctx_t *ctx) {
     struct undo_state *undo = ctx->model.undo_state;
-    return undo && undo->current < undo->count;
+    return undo && *redo_of(undo, undo->cur) >= 0;
 }
 
 void undo_clear(editor_ctx_t *ctx) {
@@ -446,16 +1652,34 @@ void undo_clear(editor_ctx_t *ctx) {
 
     struct undo_state *undo = ctx->model.undo_state;
 
-    /* Free all line content */
-    for (int i = 0; i < undo->count; i++) {
-        free_entry_data(&undo->entries[i], undo);
-    }
-
-    undo->count = 0;
-    undo->head = 0;
-    undo->current = 0;
-    undo->memory_used = 0;
-    undo->current_group_id = 0;
+    /* The text as it is becomes the root, on disk too */
+    journal_start(undo);
+    close_group(undo);
+    int depth;
+    long long record = state_record(undo, &depth);
+    undo->opened_record = -1;
+    if (undo->journal) undo_journal_unmap(undo->journal);
+
+    /* Free all entry data */
+    for (int i = undo->node_head; i < undo->nnodes; i++)
+        if (undo->nodes[i].live) node_release(undo, i);
+
+    undo->nnodes = undo->node_head = 0;
+    undo->node_base = 1;
+    undo->live_nodes = 0;
+    undo->nentries = 0;
+    undo->live_entries = undo->packed_entries = 0;
+    undo->pack_from = 0;
+    undo->root_first = undo->root_redo = -1;
+    undo->root_seq = 0;
+    undo->root_time = 0;
+    undo->cur = undo->cur_top = undo->open = -1;
+    undo->depth_base = undo->path_base = 0;
+    undo->memory_used = undo->text_used = 0;
+    undo->root_record = record;
+    undo->depth_origin = depth;
+    if (undo->recorder)
+        undo->recorder(undo->recorder_data, UNDO_RECORD_RESET, NULL, 0, 0);
 }
 
 void undo_get_stats(editor_ctx_t *ctx, int *undo_levels,
@@ -468,7 +1692,390 @@ void undo_get_stats(editor_ctx_t *ctx, int *undo_levels,
         return;
     }
 
-    if (undo_levels) *undo_levels = undo->current;
-    if (redo_levels) *redo_levels = undo->count - undo->current;
-    if (memory) *memory = undo->memory_used;
+    if (undo_levels)
+        *undo_levels = undo->cur < 0 ? 0 : undo->nodes[undo->cur].path - undo->path_base;
+    if (redo_levels) {
+        *redo_levels = 0;
+        for (int n = *redo_of(undo, undo->cur); n >= 0; n = undo->nodes[n].redo_child)
+            *redo_levels += undo->nodes[n].count;
+    }
+    if (memory) *memory = undo->text_used;
+}
+
+void undo_get_memory_stats(editor_ctx_t *ctx, undo_memory_stats_t *st) {
+    struct undo_state *undo = ctx->model.undo_state;
+    memset(st, 0, sizeof(*st));
+    if (!undo) return;
+
+    st->total = undo->memory_used;
+    st->limit = undo->memory_limit;
+    st->text = undo->text_used;
+    st->entries = undo->live_entries;
+    st->groups = undo->live_nodes;
+    for (int n = undo->node_head; n < undo->nnodes; n++) {
+        const undo_node_t *node = &undo->nodes[n];
+        if (!node->live) continue;
+        if (node->pack) {
+            st->packed += (size_t)node->pack_cap;
+            st->packed_groups++;
+            continue;
+        }
+        for (int i = node->first; i < node->first + node->count; i++) {
+            const undo_entry_t *e = &undo->entries[i];
+            if (e->type != UNDO_REPLACE_ROWS || !e->data.rows_op->old_share)
+                continue;
+            const undo_rows_t *rows = e->data.rows_op;
+            for (int r = 0; r < rows->count; r++) {
+                if (rows->old_share[r] && rows->old_share[r]->refs > 1)
+                    st->shared += (size_t)rows->old_len[r];
+                if (rows->new_share[r] && rows->new_share[r]->refs > 1)
+                    st->shared += (size_t)rows->new_len[r];
+            }
+        }
+    }
+}
+
+void undo_damage_packs(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+    for (int i = undo->node_head; i < undo->nnodes; i++)
+        if (undo->nodes[i].live && undo->nodes[i].pack) undo->nodes[i].pack_len = 0;
+}
+
+/* ======================== Persistent History ======================== */
+
+/* Hash of the buffer as save_model() writes it */
+static uint64_t model_hash(const EditorModel *model) {
+    uint64_t h = UNDO_JOURNAL_HASH_INIT;
+    for (int i = 0; i < model->numrows; i++) {
+        h = undo_journal_hash(h, model->row[i].chars, (size_t)model->row[i].size);
+        h = undo_journal_hash(h, "\n", 1);
+    }
+    return h;
+}
+
+/* A group read back from the journal, its entries in scratch */
+typedef struct {
+    long long record;
+    time_t time;
+    int first, count;
+} journal_group;
+
+/* Read back the groups that led to the state the file was opened in, the
+ * newest first, as many as fit in the limits, and put them in front of
+ * the tree: that state (the root) becomes the newest of them, and the
+ * root the state before the oldest. */
+static void import_history(struct undo_state *undo) {
+    long long at = undo->opened_record;
+    if (at < 0) return;
+    undo->opened_record = -1;
+
+    journal_group *groups = NULL;
+    undo_entry_t *got = NULL;
+    int n = 0, groups_cap = 0, total = 0, got_cap = 0;
+    UndoJournalRecord rec;
+    while (undo_journal_read(undo->journal, at, &rec) == 0 && rec.count > 0) {
+        if (undo->live_entries + total + rec.count > undo->capacity ||
+            undo->memory_used + rec.size > undo->memory_limit)
+            break;
+        if (n == groups_cap) {
+            groups_cap = groups_cap ? groups_cap * 2 : 64;
+            groups = realloc(groups, sizeof(journal_group) * (size_t)groups_cap);
+        }
+        if (total + rec.count > got_cap) {
+            while (total + rec.count > got_cap) got_cap = got_cap ? got_cap * 2 : 64;
+            got = realloc(got, sizeof(undo_entry_t) * (size_t)got_cap);
+        }
+        if (groups == NULL || got == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+
+        entry_reader r = { rec.body, rec.body + rec.size };
+        int done = 0;
+        while (done < rec.count && decode_entry(undo, &r, &got[total + done]) == 0)
+            entry_held(undo, &got[total + done++]);
+        if (done < rec.count) {
+            while (done > 0) free_entry_data(&got[total + --done], undo);
+            break;
+        }
+        groups[n].record = at;
+        groups[n].time = rec.time;
+        groups[n].first = total;
+        groups[n].count = rec.count;
+        n++;
+        total += rec.count;
+        at = rec.parent;
+    }
+    undo_journal_unmap(undo->journal);
+    if (n == 0) {
+        free(groups);
+        free(got);
+        return;
+    }
+
+    /* Room in front: the groups, then dead slots for those the numbers
+     * of the later ones skip (slots compacted away before) */
+    int pad = undo->node_base - undo->root_seq - 1;
+    int shift = n + pad;
+    if (undo->nnodes + shift > undo->nodes_cap) {
+        int cap = undo->nodes_cap ? undo->nodes_cap : 64;
+        while (cap < undo->nnodes + shift) cap *= 2;
+        undo_node_t *nodes = mem_realloc(MEM_TAG_UNDO, undo->nodes,
+                                         sizeof(undo_node_t) * (size_t)cap);
+        if (nodes == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->nodes = nodes;
+        undo->nodes_cap = cap;
+    }
+    if (undo->nentries + total > undo->entries_cap) {
+        int cap = undo->entries_cap ? undo->entries_cap : 64;
+        while (cap < undo->nentries + total) cap *= 2;
+        undo_entry_t *entries = mem_realloc(MEM_TAG_UNDO, undo->entries,
+                                        sizeof(undo_entry_t) * (size_t)cap);
+        if (entries == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo->entries = entries;
+        undo->entries_cap = cap;
+    }
+    memmove(undo->nodes + shift, undo->nodes, sizeof(undo_node_t) * (size_t)undo->nnodes);
+    memmove(undo->entries + total, undo->entries, sizeof(undo_entry_t) * (size_t)undo->nentries);
+    for (int i = shift; i < undo->nnodes + shift; i++) {
+        undo_node_t *nd = &undo->nodes[i];
+        if (!nd->live) continue;
+        nd->parent = nd->parent >= 0 ? nd->parent + shift : n - 1;
+        if (nd->first_child >= 0) nd->first_child += shift;
+        if (nd->next_sibling >= 0) nd->next_sibling += shift;
+        if (nd->redo_child >= 0) nd->redo_child += shift;
+        if (!nd->pack) nd->first += total;
+        nd->depth += n;
+        nd->path += total;
+    }
+
+    /* The groups, oldest first, each the only child of the one before */
+    int path = 0;
+    for (int i = 0; i < n; i++) {
+        const journal_group *g = &groups[n - 1 - i];
+        undo_node_t *nd = &undo->nodes[i];
+        int last = i == n - 1;
+        nd->parent = i - 1;
+        nd->next_sibling = -1;
+        nd->first_child = last ? (undo->root_first >= 0 ? undo->root_first + shift : -1) : i + 1;
+        nd->redo_child = last ? (undo->root_redo >= 0 ? undo->root_redo + shift : -1) : i + 1;
+        nd->first = path;
+        nd->count = g->count;
+        memcpy(undo->entries + path, got + g->first, sizeof(undo_entry_t) * (size_t)g->count);
+        path += g->count;
+        nd->depth = i + 1;
+        nd->path = path;
+        nd->time = g->time;
+        nd->live = 1;
+        nd->record = g->record;
+        nd->pack = NULL;
+    }
+    for (int i = n; i < shift; i++) {
+        undo->nodes[i].live = 0;
+        undo->nodes[i].count = 0;
+        undo->nodes[i].pack = NULL;
+        undo->nodes[i].time = groups[0].time;
+    }
+
+    undo->nnodes += shift;
+    undo->nentries += total;
+    undo->live_nodes += n;
+    undo->live_entries += total;
+    undo->memory_used += sizeof(undo_node_t) * (size_t)n;
+    undo->pack_from = 0;
+    undo->node_head = 0;
+    undo->node_base -= shift;
+    undo->root_first = undo->root_redo = 0;
+    undo->cur = undo->cur >= 0 ? undo->cur + shift : n - 1;
+    undo->cur_top = 0;
+    if (undo->open >= 0) undo->open += shift;
+    undo->root_seq -= n;
+    undo->root_time = 0;
+    undo->root_record = at;
+    undo->depth_origin -= n;
+    free(groups);
+    free(got);
+}
+
+/* Hash of the text as opened, on the task pool */
+static void hash_opened(void *arg) {
+    struct undo_state *undo = arg;
+    const EditorSnapshot *text = undo->opened_text;
+    uint64_t h = UNDO_JOURNAL_HASH_INIT;
+    for (int i = 0; i < editor_snapshot_numrows(text); i++) {
+        size_t len;
+        const char *row = editor_snapshot_row(text, i, &len);
+        h = undo_journal_hash(h, row, len);
+        h = undo_journal_hash(h, "\n", 1);
+    }
+    undo->opened_hash = h;
+}
+
+void undo_history_open(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+
+    journal_drop(undo);
+    undo_clear(ctx);
+    undo->root_record = -1;
+    undo->depth_origin = 0;
+    if (!ctx->model.filename) return;
+
+    undo->journal_path = strdup(ctx->model.filename);
+    if (undo->journal_path == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    undo->opened_text = editor_model_snapshot(ctx);
+    task_token_init(&undo->hash_token);
+    undo->hash_task = task_submit(hash_opened, undo, TASK_PRIORITY_LOW,
+                                  &undo->hash_token);
+}
+
+/* The history is used for the first time since the file was opened: open
+ * its journal, and continue the history there if the file was saved with
+ * the text it was opened with */
+static void journal_start(struct undo_state *undo) {
+    if (!undo->opened_text) return;
+    if (!undo->hash_task || !task_wait(undo->hash_task)) hash_opened(undo);
+    undo->hash_task = NULL;
+    editor_snapshot_release(undo->opened_text);
+    undo->opened_text = NULL;
+
+    undo->journal = undo_journal_open(undo->journal_path);
+    if (!undo->journal) {
+        journal_drop(undo);
+        return;
+    }
+
+    UndoJournalRecord saved;
+    if (!undo_journal_find_save(undo->journal, undo->opened_hash, &saved))
+        return;
+    undo->root_record = undo->opened_record = saved.parent;
+    undo->depth_origin = saved.depth;
+    undo->root_seq = saved.depth;
+    undo->node_base = saved.depth + 1;
+    undo->root_time = saved.time;
+    if (saved.parent < 0) undo_journal_unmap(undo->journal);
+}
+
+static void history_saved(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!ctx->model.filename) return;
+
+    /* Saved under another name: the history goes to that file's journal */
+    if (undo->journal_path && strcmp(undo->journal_path, ctx->model.filename) != 0)
+        journal_drop(undo);
+    journal_start(undo);
+
+    if (undo->journal) {
+        close_group(undo);
+    } else {
+        undo->journal = undo_journal_open(ctx->model.filename);
+        if (!undo->journal) return;
+        undo->journal_path = strdup(ctx->model.filename);
+        if (undo->journal_path == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        undo_journal_unmap(undo->journal);
+
+        /* The history so far, parents before children */
+        undo->open = -1;
+        undo->root_record = -1;
+        undo->depth_origin = 0;
+        for (int i = undo->node_head; i < undo->nnodes; i++)
+            undo->nodes[i].record = -1;
+        for (int i = undo->node_head; i < undo->nnodes && undo->journal; i++)
+            journal_write(undo, i);
+        if (!undo->journal) return;
+    }
+
+    int depth;
+    UndoJournalRecord rec = {
+        .type = UNDO_JOURNAL_SAVE,
+        .parent = state_record(undo, &depth),
+        .time = undo_state_time(ctx),
+        .hash = model_hash(&ctx->model),
+    };
+    rec.depth = depth;
+    if (undo_journal_append(undo->journal, &rec) < 0) journal_drop(undo);
+}
+
+void undo_history_saved(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+
+    /* The group it closes is in the file now, not to be recorded */
+    UndoRecorder recorder = undo->recorder;
+    undo->recorder = NULL;
+    history_saved(ctx);
+    close_group(undo);
+    undo->recorder = recorder;
+    if (recorder) recorder(undo->recorder_data, UNDO_RECORD_SAVED, NULL, 0, 0);
+}
+
+void undo_history_detach(editor_ctx_t *ctx) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+
+    journal_drop(undo);
+    undo_clear(ctx);
+    undo->root_record = -1;
+    undo->depth_origin = 0;
+}
+
+/* ======================== Crash Recovery ======================== */
+
+void undo_set_recorder(editor_ctx_t *ctx, UndoRecorder recorder, void *data) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo) return;
+    undo->recorder = recorder;
+    undo->recorder_data = data;
+}
+
+int undo_open_group(editor_ctx_t *ctx, const char **body, size_t *size, int *count) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || undo->open < 0 || undo->open != undo->cur ||
+        undo->nodes[undo->open].count == 0)
+        return 0;
+    if (node_serialize(undo, undo->open) == -1) return 0;
+    *body = undo->jbuf;
+    *size = undo->jlen;
+    *count = undo->nodes[undo->open].count;
+    return 1;
+}
+
+int undo_replay(editor_ctx_t *ctx, const char *body, size_t size, int count,
+                int backwards) {
+    struct undo_state *undo = ctx->model.undo_state;
+    if (!undo || count <= 0) return -1;
+
+    undo_entry_t *entries = malloc(sizeof(undo_entry_t) * (size_t)count);
+    if (entries == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    entry_reader r = { body, body + size };
+    int n = 0;
+    while (n < count && decode_entry(undo, &r, &entries[n]) == 0) {
+        entry_held(undo, &entries[n]);
+        n++;
+    }
+    int ok = n == count && r.p == r.end;
+    for (int i = 0; ok && i < count; i++) {
+        if (backwards) apply_undo(ctx, &entries[count - 1 - i]);
+        else apply_redo(ctx, &entries[i]);
+    }
+    for (int i = 0; i < n; i++) free_entry_data(&entries[i], undo);
+    free(entries);
+    if (ok) ctx->model.dirty++;
+    return ok ? 0 : -1;
 }
@@ -2,8 +2,25 @@
  *
  * This module implements undo/redo with operation grouping and memory limits.
  * Operations are grouped by heuristics (time gap, cursor movement, operation type).
+ * Characters typed or deleted one after another in a row go into a single
+ * text run entry, which is undone or redone with one rewrite of the row.
+ * Bulk edits (a selection deleted, text inserted from Lua) record the span
+ * they replaced as one range entry instead of a character at a time.
+ *
+ * Groups form a tree, as in vim: an edit made after an undo starts a new
+ * branch and the undone groups stay reachable. Groups are numbered in the
+ * order they were made; the buffer's state is named by the number of the
+ * group that led to it (0 for the original text). Undo goes to the parent
+ * state, redo to the child last left or made, and undo_goto() to any kept
+ * state. When the history passes its entry or memory limit, the oldest
+ * group is dropped, together with the branches that only it led to.
+ *
+ * Each group is also appended to the file's undo journal when it closes
+ * (see undo_journal.h), and every save is noted there. Reopening a file
+ * finds the state that was saved; the groups that led to it are read
+ * back the first time undo goes past it, as many as the limits allow.
+ * Branches off that path stay on disk only.
  */
-
 #ifndef LOKI_UNDO_H
 #define LOKI_UNDO_H
 
@@ -13,12 +30,32 @@
 
 /* Operation types that can be undone */
 typedef enum {
-    UNDO_INSERT_CHAR,    /* Insert single character */
-    UNDO_DELETE_CHAR,    /* Delete single character */
+    UNDO_INSERT_TEXT,    /* Insert a run of characters */
+    UNDO_DELETE_TEXT,    /* Delete a run of characters */
     UNDO_INSERT_LINE,    /* Insert newline (split line) */
     UNDO_DELETE_LINE,    /* Delete newline (merge lines) */
+    UNDO_REPLACE_ROWS,   /* Replace the contents of many rows (e.g. :%s) */
+    UNDO_REPLACE_RANGE,  /* Replace a span of text, newlines and all */
 } undo_op_type_t;
 
+struct RowShare;
+
+/* Rows whose contents were replaced, collected with undo_rows_add() or
+ * undo_rows_set(). A row set by undo_rows_set() holds its old and new
+ * contents as blocks shared with the buffer (see editor_row_share()), so
+ * none of its text is copied; the others' are copied back to back. */
+typedef struct undo_rows {
+    int count, cap;
+    int *row;                /* Row numbers, ascending */
+    int *old_len, *new_len;  /* Content lengths, per row */
+    char *old_text, *new_text;          /* Copied contents, back to back */
+    size_t old_size, new_size;
+    size_t old_cap, new_cap;
+    struct RowShare **old_share, **new_share; /* Per row, NULL if copied
+                                               * (NULL if none shared) */
+    size_t shared_size;      /* Bytes of the shared contents */
+} undo_rows_t;
+
 /* Single undo operation */
 typedef struct {
     undo_op_type_t type;     /* Operation type */
@@ -28,13 +65,24 @@ typedef struct {
     /* Operation-specific data */
     union {
         struct {
-            char ch;         /* Character inserted/deleted */
-        } char_op;
+            char *text;      /* Characters inserted/deleted, from col on */
+            int length, cap;
+        } text_op;
 
         struct {
             char *content;   /* Line content (for line ops) */
             int length;      /* Content length */
+            int cap;
         } line_op;
+
+        undo_rows_t *rows_op;    /* Rows replaced (owned by the entry) */
+
+        struct {
+            char *text;      /* The text removed from (row, col), then the
+                              * text put there, back to back */
+            int old_len, new_len;
+            int cap;
+        } range_op;
     } data;
 
     /* Cursor position before operation (for undo restoration) */
@@ -42,10 +90,6 @@ typedef struct {
     int cursor_col;
     int cursor_rowoff;
     int cursor_coloff;
-
-    /* Grouping information */
-    int group_id;            /* Operations with same group_id undo together */
-    int group_break;         /* 1 = explicit break after this operation */
 } undo_entry_t;
 
 /* Undo state (opaque - definition in loki_undo.c) */
@@ -54,31 +98,98 @@ struct undo_state;
 /* ======================== Public API ======================== */
 
 /* Initialize undo system
- * capacity: Max number of undo operations (e.g., 1000)
- * memory_limit: Max bytes for line content (e.g., 10MB) */
+ * capacity: Max number of undo operations, in all branches (e.g., 1000)
+ * memory_limit: Max bytes held by them, all told (e.g., 10MB). Past it,
+ *   the oldest groups are compressed, then dropped. */
 void undo_init(editor_ctx_t *ctx, int capacity, size_t memory_limit);
 
 /* Free undo system resources */
 void undo_free(editor_ctx_t *ctx);
 
 /* Record an edit operation (called by editor_insert_char, etc.)
- * These save cursor position BEFORE the operation for proper undo restoration */
+ * These save cursor position BEFORE the operation for proper undo restoration.
+ * A character inserted right after the newest text run of the current group,
+ * or deleted right before it or at its start (backspace, forward delete),
+ * extends that run instead of taking an entry of its own. */
 void undo_record_insert_char(editor_ctx_t *ctx, int row, int col, char ch);
 void undo_record_delete_char(editor_ctx_t *ctx, int row, int col, char ch);
 void undo_record_insert_line(editor_ctx_t *ctx, int row, int col, const char *content, int length);
 void undo_record_delete_line(editor_ctx_t *ctx, int row, int col, const char *content, int length);
 
+/* Note that 'row' went from 'old_text' to 'new_text'. Rows are added in
+ * ascending order. */
+void undo_rows_add(undo_rows_t *rows, int row, const char *old_text,
+                   int old_len, const char *new_text, int new_len);
+
+/* Set 'row' of the buffer to the 'new_len' bytes at 'new_text' with
+ * editor_row_set(), noting the change as undo_rows_add() would. The old
+ * and new contents are shared with the buffer, not copied: recording a
+ * bulk edit costs nothing per row beyond the edit itself. */
+void undo_rows_set(undo_rows_t *rows, editor_ctx_t *ctx, int row,
+                   const char *new_text, int new_len);
+void undo_rows_free(undo_rows_t *rows);
+
+/* Record the replacements in 'rows' as one operation in a group of its
+ * own, taking them over ('rows' is left empty). */
+void undo_record_replace_rows(editor_ctx_t *ctx, undo_rows_t *rows);
+
+/* Record that the 'old_len' bytes at 'old_text' from (row, col) on were
+ * replaced by the 'new_len' bytes at 'new_text' (both may hold newlines),
+ * as one operation in a group of its own. editor_replace_range() calls
+ * it; undo and redo replay the edit with editor_replace_range() again. */
+void undo_record_replace_range(editor_ctx_t *ctx, int row, int col,
+                               const char *old_text, int old_len,
+                               const char *new_text, int new_len);
+
 /* Force start of new undo group (e.g., after mode change, after delay) */
 void undo_break_group(editor_ctx_t *ctx);
 
-/* Undo last operation/group
- * Returns: 1 if undo performed, 0 if nothing to undo */
+/* Record the edits made until the matching undo_release_group() as one
+ * group, one undo step, however many entries they take (a reload patching
+ * the places that changed, a filter run over many ticks). Calls nest.
+ * While a group is held, undo and redo do nothing. */
+void undo_hold_group(editor_ctx_t *ctx);
+void undo_release_group(editor_ctx_t *ctx);
+
+/* Undo last operation/group (go to the parent state)
+ * Returns: 1 if undo performed, 0 if nothing to undo, -2 if the group
+ * couldn't be read back from its packed form (the status line says so) */
 int undo_perform(editor_ctx_t *ctx);
 
-/* Redo previously undone operation/group
- * Returns: 1 if redo performed, 0 if nothing to redo */
+/* Redo previously undone operation/group (go to the child state last left
+ * or made)
+ * Returns: 1 if redo performed, 0 if nothing to redo, -2 as undo_perform() */
 int redo_perform(editor_ctx_t *ctx);
 
+/* ======================== The Undo Tree ======================== */
+
+/* The state the buffer is in: the number of the group that led to it, or
+ * of the oldest state kept (0 while nothing was dropped). *newest, if not
+ * NULL, gets the number of the newest group. */
+int undo_state_seq(editor_ctx_t *ctx, int *newest);
+
+/* When the current state was made (0 for one older than the history) */
+time_t undo_state_time(editor_ctx_t *ctx);
+
+/* Go to the state after group 'seq', undoing up to the branch it is on
+ * and redoing down to it. The group is found in O(1); the edits replayed
+ * are those on the way.
+ * Returns: 1 if the buffer changed, 0 if already there, -1 if the state
+ * is not kept, -2 if a group on the way couldn't be read back (the buffer
+ * is left in the state reached before it) */
+int undo_goto(editor_ctx_t *ctx, int seq);
+
+/* Move 'steps' states back (negative) or forward in the order they were
+ * made, across branches (vim's g- and g+). Dropped states are passed over.
+ * Returns: 1 if the buffer changed, 0 if already at the oldest or newest,
+ * -2 as undo_goto() */
+int undo_step(editor_ctx_t *ctx, int steps);
+
+/* Go to the newest state made at or before 'when' (binary search by
+ * time), or the oldest kept if all are newer.
+ * Returns: 1 if the buffer changed, 0 if already there, -2 as undo_goto() */
+int undo_goto_time(editor_ctx_t *ctx, time_t when);
+
 /* Check if undo/redo available */
 int undo_can_undo(editor_ctx_t *ctx);
 int undo_can_redo(editor_ctx_t *ctx);
@@ -86,7 +197,82 @@ int undo_can_redo(editor_ctx_t *ctx);
 /* Clear all undo history (e.g., after file save or major change) */
 void undo_clear(editor_ctx_t *ctx);
 
-/* Get undo statistics (for debugging/status display) */
+/* ======================== Persistent History ======================== */
+
+/* The buffer was just loaded from ctx->model.filename: start a fresh
+ * history, continuing the one in the file's journal if it was saved with
+ * these contents. The contents are hashed on the task pool; the journal
+ * is opened, and only its last records read, when the history is first
+ * used (an edit, an undo, or a question about its states). */
+void undo_history_open(editor_ctx_t *ctx);
+
+/* The buffer was just written to ctx->model.filename: close the open
+ * group and note the save in the journal, which is started if the file
+ * had none. */
+void undo_history_saved(editor_ctx_t *ctx);
+
+/* Start a history of the current text, cut off from the file's journal:
+ * the text is no longer the one the journal's records lead to (see
+ * recovery.h). */
+void undo_history_detach(editor_ctx_t *ctx);
+
+/* ======================== Crash Recovery ======================== */
+
+/* What a recorder is told; see undo_set_recorder() */
+enum {
+    UNDO_RECORD_GROUP = 1,  /* A group closed: its entries were applied */
+    UNDO_RECORD_UNDO,       /* A group is being undone */
+    UNDO_RECORD_REDO,       /* A group is being redone */
+    UNDO_RECORD_RESET,      /* The history was cleared (no entries) */
+    UNDO_RECORD_SAVED       /* The text was written to its file (no entries) */
+};
+
+/* Called with 'count' entries serialized in 'size' bytes at 'body', as
+ * undo_replay() reads them; valid during the call only. */
+typedef void (*UndoRecorder)(void *data, int kind, const char *body,
+                             size_t size, int count);
+
+/* Have 'recorder' told of every change the history makes to the text, in
+ * order: replaying them from the text as the last reset found it gives
+ * the text as it is, but for the open group's entries. NULL stops it. */
+void undo_set_recorder(editor_ctx_t *ctx, UndoRecorder recorder, void *data);
+
+/* The open group's entries so far, serialized as for the recorder (valid
+ * until the next edit). Returns 1, or 0 if no group is open. */
+int undo_open_group(editor_ctx_t *ctx, const char **body, size_t *size, int *count);
+
+/* Apply entries a recorder was given, forward (as done or redone), or
+ * 'backwards' (as undone), without recording them. Returns 0, or -1 if
+ * they are malformed (and none were applied). */
+int undo_replay(editor_ctx_t *ctx, const char *body, size_t size, int count,
+                int backwards);
+
+/* Get undo statistics (for debugging/status display): the operations
+ * from the oldest state kept to the current one, those redo_perform()
+ * would replay one after another, and the bytes of text held in all
+ * branches */
 void undo_get_stats(editor_ctx_t *ctx, int *undo_levels, int *redo_levels, size_t *memory);
 
+/* What the history holds, filled in by undo_get_memory_stats() */
+typedef struct undo_memory_stats {
+    size_t total;     /* Bytes held: entry and group slots, row lists and
+                       * text blocks at their allocated sizes. This is
+                       * what the memory limit applies to. */
+    size_t limit;     /* The memory limit */
+    size_t text;      /* Bytes of text in the entries, packed or not (as
+                       * undo_get_stats() reports) */
+    size_t shared;    /* Of total, row contents also held by the buffer
+                       * or by other entries */
+    size_t packed;    /* Of total, the blocks of packed groups */
+    int entries;      /* Entries in all branches */
+    int groups;       /* Groups in all branches */
+    int packed_groups; /* Of those, packed: compressed until undo or redo
+                        * goes through them */
+} undo_memory_stats_t;
+
+void undo_get_memory_stats(editor_ctx_t *ctx, undo_memory_stats_t *st);
+
+/* Make the packed groups unreadable, as damaged memory would. For tests. */
+void undo_damage_packs(editor_ctx_t *ctx);
+
 #endif /* LOKI_UNDO_H */
@@ -0,0 +1,335 @@
+/* undo_journal.c - Undo history kept on disk
+ *
+ * See undo_journal.h for an overview. The journal's records are read
+ * through a private read-only mapping of the file as it was opened;
+ * appends go through the descriptor, past the end of the mapping, so the
+ * two never meet.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE     /* realpath(), fsync() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "undo_journal.h"
+#include "loki.h"
+
+/* "LKUJ" and "LKUR", as read from a little-endian file */
+#define JOURNAL_MAGIC 0x4A554B4C
+#define RECORD_MAGIC 0x52554B4C
+#define JOURNAL_VERSION 1
+
+/* The start of the journal; the file's absolute path follows */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t path_len;
+    uint32_t reserved;
+} journal_header;
+
+/* The start of every record; its body and then its length follow */
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t size;           /* Bytes of body */
+    uint32_t crc;            /* CRC-32 of this header (crc 0) and the body */
+    int64_t parent;
+    int64_t time;
+    uint64_t hash;
+    int32_t depth;
+    int32_t count;
+} record_header;
+
+#define RECORD_OVERHEAD (sizeof(record_header) + sizeof(uint32_t))
+
+struct UndoJournal {
+    int fd;
+    const char *map;         /* The file as opened, or NULL */
+    size_t map_size;
+    size_t start;            /* Offset of the first record */
+    size_t end;              /* Offset the next record goes to */
+    size_t read_end;         /* Records below this can be read */
+};
+
+static char *journal_dir = NULL;
+static int journal_dir_set = 0;
+
+void undo_journal_set_dir(const char *dir) {
+    free(journal_dir);
+    journal_dir = dir ? strdup(dir) : NULL;
+    journal_dir_set = dir != NULL;
+}
+
+uint64_t undo_journal_hash(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+/* ======================== Checksums ======================== */
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(record_header hdr, const char *body) {
+    hdr.crc = 0;
+    uint32_t crc = crc32_update(0, &hdr, sizeof(hdr));
+    return crc32_update(crc, body, hdr.size);
+}
+
+/* ======================== Opening ======================== */
+
+/* The directory journals go in, created if missing, or NULL */
+static char *resolve_dir(void) {
+    char dir[PATH_MAX];
+    struct stat st;
+    if (journal_dir_set) {
+        if (journal_dir == NULL || journal_dir[0] == '\0') return NULL;
+        snprintf(dir, sizeof(dir), "%s", journal_dir);
+    } else if (stat(LOKI_CONFIG_DIR, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(dir, sizeof(dir), "%s/undo", LOKI_CONFIG_DIR);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) return NULL;
+        snprintf(dir, sizeof(dir), "%s/%s", home, LOKI_CONFIG_DIR);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+        snprintf(dir, sizeof(dir), "%s/%s/undo", home, LOKI_CONFIG_DIR);
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+    return strdup(dir);
+}
+
+/* Length of the valid record at 'off', below 'limit', or 0 (headers and
+ * lengths only; the checksum is checked when the record is read) */
+static size_t record_at(const UndoJournal *j, size_t off, size_t limit,
+                        record_header *hdr) {
+    if (off < j->start || off > limit || limit - off < RECORD_OVERHEAD)
+        return 0;
+    memcpy(hdr, j->map + off, sizeof(*hdr));
+    if (hdr->magic != RECORD_MAGIC) return 0;
+    if (hdr->size > limit - off - RECORD_OVERHEAD) return 0;
+    size_t len = RECORD_OVERHEAD + hdr->size;
+    uint32_t trailer;
+    memcpy(&trailer, j->map + off + len - sizeof(trailer), sizeof(trailer));
+    return trailer == len ? len : 0;
+}
+
+/* The record ending at 'end', or 0 */
+static size_t record_before(const UndoJournal *j, size_t end,
+                            record_header *hdr, size_t *off) {
+    uint32_t len;
+    if (end < j->start + RECORD_OVERHEAD) return 0;
+    memcpy(&len, j->map + end - sizeof(len), sizeof(len));
+    if (len < RECORD_OVERHEAD || len > end - j->start) return 0;
+    *off = end - len;
+    return record_at(j, *off, end, hdr) == len ? len : 0;
+}
+
+/* Where the valid records end: the end of the file, unless the last
+ * record was cut short, in which case up to the last whole one */
+static size_t valid_end(const UndoJournal *j) {
+    record_header hdr;
+    size_t off, len;
+    if (j->map_size == j->start || record_before(j, j->map_size, &hdr, &off))
+        return j->map_size;
+    off = j->start;
+    while ((len = record_at(j, off, j->map_size, &hdr)) > 0) off += len;
+    return off;
+}
+
+/* Start the file afresh: a header naming 'path' and no records */
+static int write_header(UndoJournal *j, const char *path) {
+    journal_header hdr = { JOURNAL_MAGIC, JOURNAL_VERSION,
+                           (uint32_t)strlen(path), 0 };
+    struct iovec iov[2] = {
+        { &hdr, sizeof(hdr) },
+        { (void *)path, hdr.path_len },
+    };
+    size_t len = sizeof(hdr) + hdr.path_len;
+    if (ftruncate(j->fd, 0) == -1 || lseek(j->fd, 0, SEEK_SET) == -1 ||
+        writev(j->fd, iov, 2) != (ssize_t)len)
+        return -1;
+    j->start = j->end = j->read_end = len;
+    return 0;
+}
+
+/* Whether the mapped file starts with the header for 'path' */
+static int header_matches(const UndoJournal *j, const char *path) {
+    journal_header hdr;
+    size_t path_len = strlen(path);
+    if (j->map_size < sizeof(hdr)) return 0;
+    memcpy(&hdr, j->map, sizeof(hdr));
+    return hdr.magic == JOURNAL_MAGIC && hdr.version == JOURNAL_VERSION &&
+           hdr.path_len == path_len &&
+           j->map_size >= sizeof(hdr) + path_len &&
+           memcmp(j->map + sizeof(hdr), path, path_len) == 0;
+}
+
+UndoJournal *undo_journal_open(const char *path) {
+    char *dir = resolve_dir();
+    if (!dir) return NULL;
+    char *abs = realpath(path, NULL);
+    if (!abs) {
+        free(dir);
+        return NULL;
+    }
+
+    char name[PATH_MAX];
+    uint64_t key = undo_journal_hash(UNDO_JOURNAL_HASH_INIT, abs, strlen(abs));
+    snprintf(name, sizeof(name), "%s/%016llx.undo", dir, (unsigned long long)key);
+    free(dir);
+
+    UndoJournal *j = calloc(1, sizeof(*j));
+    if (!j) {
+        perror("Out of memory");
+        exit(1);
+    }
+    j->fd = open(name, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (j->fd == -1 || fstat(j->fd, &st) == -1) goto fail;
+
+    j->map_size = (size_t)st.st_size;
+    if (j->map_size > 0) {
+        void *map = mmap(NULL, j->map_size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+        if (map == MAP_FAILED) goto fail;
+        j->map = map;
+    }
+
+    if (!header_matches(j, abs)) {
+        undo_journal_unmap(j);
+        if (write_header(j, abs) == -1) goto fail;
+    } else {
+        j->start = sizeof(journal_header) + strlen(abs);
+        j->end = j->read_end = valid_end(j);
+        if (j->end < j->map_size && ftruncate(j->fd, (off_t)j->end) == -1)
+            goto fail;
+    }
+    free(abs);
+    return j;
+
+fail:
+    free(abs);
+    undo_journal_close(j);
+    return NULL;
+}
+
+void undo_journal_unmap(UndoJournal *j) {
+    if (j->map) munmap((void *)j->map, j->map_size);
+    j->map = NULL;
+    j->map_size = 0;
+    j->read_end = 0;
+}
+
+void undo_journal_close(UndoJournal *j) {
+    if (!j) return;
+    undo_journal_unmap(j);
+    if (j->fd != -1) close(j->fd);
+    free(j);
+}
+
+/* ======================== Reading ======================== */
+
+static void fill_record(const UndoJournal *j, size_t off,
+                        const record_header *hdr, UndoJournalRecord *rec) {
+    rec->type = (int)hdr->type;
+    rec->parent = hdr->parent;
+    rec->depth = hdr->depth;
+    rec->count = hdr->count;
+    rec->time = (time_t)hdr->time;
+    rec->hash = hdr->hash;
+    rec->body = j->map + off + sizeof(*hdr);
+    rec->size = hdr->size;
+}
+
+int undo_journal_find_save(UndoJournal *j, uint64_t hash,
+                           UndoJournalRecord *saved) {
+    record_header hdr;
+    size_t off;
+    for (size_t end = j->read_end; end > j->start; end = off) {
+        if (!record_before(j, end, &hdr, &off)) break;
+        if (hdr.type == UNDO_JOURNAL_SAVE && hdr.hash == hash &&
+            hdr.crc == record_crc(hdr, j->map + off + sizeof(hdr))) {
+            fill_record(j, off, &hdr, saved);
+            return 1;
+        }
+    }
+
+    /* The file was changed elsewhere: the old history is no use */
+    undo_journal_unmap(j);
+    if (ftruncate(j->fd, (off_t)j->start) == 0) j->end = j->start;
+    return 0;
+}
+
+int undo_journal_read(UndoJournal *j, long long offset, UndoJournalRecord *rec) {
+    record_header hdr;
+    if (!j->map || offset < 0) return -1;
+    size_t off = (size_t)offset;
+    if (off >= j->read_end || !record_at(j, off, j->read_end, &hdr)) return -1;
+    if (hdr.type != UNDO_JOURNAL_GROUP ||
+        hdr.crc != record_crc(hdr, j->map + off + sizeof(hdr)))
+        return -1;
+    fill_record(j, off, &hdr, rec);
+    return 0;
+}
+
+/* ======================== Appending ======================== */
+
+long long undo_journal_append(UndoJournal *j, const UndoJournalRecord *rec) {
+    if (rec->size > UINT32_MAX - RECORD_OVERHEAD) return -1;
+    record_header hdr = {
+        .magic = RECORD_MAGIC,
+        .type = (uint32_t)rec->type,
+        .size = (uint32_t)rec->size,
+        .parent = rec->parent,
+        .time = (int64_t)rec->time,
+        .hash = rec->hash,
+        .depth = rec->depth,
+        .count = rec->count,
+    };
+    hdr.crc = record_crc(hdr, rec->body);
+    uint32_t len = (uint32_t)(RECORD_OVERHEAD + rec->size);
+    struct iovec iov[3] = {
+        { &hdr, sizeof(hdr) },
+        { (void *)rec->body, rec->size },
+        { &len, sizeof(len) },
+    };
+
+    if (lseek(j->fd, (off_t)j->end, SEEK_SET) == -1 ||
+        writev(j->fd, iov, 3) != (ssize_t)len ||
+        (rec->type == UNDO_JOURNAL_SAVE && fsync(j->fd) == -1)) {
+        /* Leave no partial record behind */
+        if (ftruncate(j->fd, (off_t)j->end) == -1) return -1;
+        return -1;
+    }
+    long long offset = (long long)j->end;
+    j->end += len;
+    return offset;
+}
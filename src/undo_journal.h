@@ -0,0 +1,88 @@
+/* undo_journal.h - Undo history kept on disk
+ *
+ * Each file's undo history is appended to a journal in .loki/undo/ (the
+ * project's .loki/ if there is one, else ~/.loki/), named after a hash
+ * of the file's absolute path. The journal is a header naming the file,
+ * then records, each checksummed and never rewritten:
+ *
+ * - a group record holds one undo group, as undo.c serializes it, and
+ *   the offset of its parent group's record (-1 for the text as first
+ *   opened), so the groups on disk form the same tree as in memory;
+ * - a save record names the group whose state was written to the file,
+ *   with a hash of the file's contents.
+ *
+ * Every record ends with its length, so the journal is read from its end
+ * backwards. Opening a file finds the newest save record whose hash is
+ * that of the contents just loaded, reading record headers only; a group
+ * body is checked and handed to undo.c only when undo first goes back
+ * past the state the file was opened in. The journal is memory-mapped for
+ * that reading. A record cut short by a crash is dropped from the end.
+ *
+ * Records are in the machine's byte order; the journal is a cache for
+ * the one machine, not an interchange format.
+ */
+
+#ifndef LOKI_UNDO_JOURNAL_H
+#define LOKI_UNDO_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Record types */
+enum {
+    UNDO_JOURNAL_GROUP = 1,
+    UNDO_JOURNAL_SAVE = 2,
+};
+
+typedef struct UndoJournal UndoJournal;
+
+/* A record read from the journal */
+typedef struct UndoJournalRecord {
+    int type;
+    long long parent;   /* Group: the parent's record; save: the state's */
+    int depth;          /* Groups from the text as first opened */
+    int count;          /* Entries in a group */
+    time_t time;
+    uint64_t hash;      /* Save: hash of the file's contents */
+    const char *body;   /* Group: the serialized entries (in the mapping) */
+    size_t size;
+} UndoJournalRecord;
+
+/* Keep journals in 'dir' (created if missing) instead of .loki/undo/,
+ * or turn persistence off with "". NULL goes back to the default. */
+void undo_journal_set_dir(const char *dir);
+
+/* Hash of the contents of 'len' bytes. Pass the previous result as 'h'
+ * to continue a hash; start with UNDO_JOURNAL_HASH_INIT. */
+#define UNDO_JOURNAL_HASH_INIT UINT64_C(0xcbf29ce484222325)
+uint64_t undo_journal_hash(uint64_t h, const void *data, size_t len);
+
+/* Open (or create) the journal for the file at 'path', which must exist.
+ * Returns NULL when persistence is off, there is no .loki/ directory, or
+ * the journal cannot be opened. */
+UndoJournal *undo_journal_open(const char *path);
+
+/* Close a journal, unmapping it. Safe on NULL. */
+void undo_journal_close(UndoJournal *j);
+
+/* Find the newest save record of the contents hashed to 'hash', as the
+ * journal was when opened. Fills 'saved' and returns 1, or returns 0
+ * (and forgets the old records: none lead to these contents). */
+int undo_journal_find_save(UndoJournal *j, uint64_t hash,
+                           UndoJournalRecord *saved);
+
+/* Read the group record at 'offset', checking its checksum, from the
+ * journal as it was when opened. Returns 0, or -1 if there is no valid
+ * group record there. */
+int undo_journal_read(UndoJournal *j, long long offset, UndoJournalRecord *rec);
+
+/* Drop the mapping of the records as they were when opened, once no
+ * more are going to be read. */
+void undo_journal_unmap(UndoJournal *j);
+
+/* Append a record ('body' and 'size' for groups). A save record is
+ * synced to disk. Returns the offset of the record, or -1 on error. */
+long long undo_journal_append(UndoJournal *j, const UndoJournalRecord *rec);
+
+#endif /* LOKI_UNDO_JOURNAL_H */
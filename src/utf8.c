@@ -0,0 +1,268 @@
+/* utf8.c - Display width of UTF-8 text
+ *
+ * See utf8.h for an overview. The width tables are sorted ranges of code
+ * points searched by bisection; they cover the Wide and Fullwidth ranges
+ * of Unicode's East Asian Width and the emoji blocks, and the combining
+ * marks and format characters of the common scripts.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+
+#if defined(__GNUC__) && !defined(UTF8_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_USE_SSE2 1
+#endif
+
+/* ======================= ASCII runs ===================================== */
+
+#ifndef UTF8_USE_SSE2
+static uint64_t load_word(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+#endif
+
+int utf8_ascii_len(const char *s, int len) {
+    int i = 0;
+#ifdef UTF8_USE_SSE2
+    /* The sign bits of 16 bytes are the non-ASCII ones */
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int m = _mm_movemask_epi8(v);
+        if (m) return i + __builtin_ctz((unsigned)m);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t high = load_word(s + i) & 0x8080808080808080ULL;
+        if (high) {
+#if defined(__GNUC__)
+            return i + __builtin_ctzll(high) / 8;
+#else
+            break;
+#endif
+        }
+    }
+#endif
+    while (i < len && !((unsigned char)s[i] & 0x80)) i++;
+    return i;
+}
+
+/* ======================= Decoding and widths ============================ */
+
+int utf8_decode(const char *s, int len, int *cp) {
+    const unsigned char *p = (const unsigned char *)s;
+    int n, c;
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    } else if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+        n = 2; c = p[0] & 0x1F;
+    } else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+        n = 3; c = p[0] & 0x0F;
+    } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+        n = 4; c = p[0] & 0x07;
+    } else {
+        *cp = -1;
+        return 1;
+    }
+    if (n > len) {
+        *cp = -1;
+        return 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    /* Overlong forms, surrogates and past U+10FFFF are no characters */
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+        (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+typedef struct {
+    int first, last;
+} CpRange;
+
+/* Zero width: combining marks, joiners and directional marks, variation
+ * selectors, emoji skin tone modifiers */
+static const CpRange zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+    {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+    {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+    {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC},
+    {0x0EC8, 0x0ECD}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+    {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+/* Two cells: East Asian Wide and Fullwidth, and emoji */
+static const CpRange wide[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+static int in_ranges(const CpRange *r, int n, int cp) {
+    if (cp < r[0].first || cp > r[n - 1].last) return 0;
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r[mid].last < cp) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && r[lo].first <= cp;
+}
+
+#define RANGES(r) (int)(sizeof(r) / sizeof((r)[0]))
+
+int utf8_cp_width(int cp) {
+    if (cp < 0x300) return 1;   /* ASCII, Latin; invalid bytes (-1) too */
+    if (in_ranges(zero_width, RANGES(zero_width), cp)) return 0;
+    if (in_ranges(wide, RANGES(wide), cp)) return 2;
+    return 1;
+}
+
+/* Cells of the characters starting in s[from..to), s being len bytes */
+static int width_span(const char *s, int len, int from, int to) {
+    int cols = 0, i = from;
+    while (i < to) {
+        int n = utf8_ascii_len(s + i, to - i);
+        i += n;
+        cols += n;
+        if (i >= to) break;
+        if (utf8_is_cont(s[i])) {
+            i++;
+            continue;
+        }
+        int cp;
+        i += utf8_decode(s + i, len - i, &cp);
+        cols += utf8_cp_width(cp);
+    }
+    return cols;
+}
+
+int utf8_width(const char *s, int len) {
+    return width_span(s, len, 0, len);
+}
+
+int utf8_fit(const char *s, int len, int cols) {
+    int i = utf8_ascii_len(s, len < cols ? len : cols);
+    int used = i;
+    while (i < len) {
+        if (utf8_is_cont(s[i])) {
+            i++;
+            continue;
+        }
+        int cp;
+        int n = utf8_decode(s + i, len - i, &cp);
+        int w = utf8_cp_width(cp);
+        if (w > 0 && used + w > cols) break;
+        used += w;
+        i += n;
+    }
+    return i;
+}
+
+/* ======================= Row checkpoints ================================ */
+
+/* Rows kept, by row number modulo; a power of two */
+#define UTF8_COLS_SLOTS 256
+
+typedef struct {
+    int row;
+    unsigned long gen;      /* 0: slot unused */
+    const char *text;
+    int len;
+    int ascii;              /* All of it: no checkpoints needed */
+    int valid;              /* col[0..valid) are up to date */
+    int cap;
+    int *col;               /* Cells before byte k * UTF8_COLS_CHUNK */
+} ColSlot;
+
+struct Utf8Cols {
+    ColSlot slot[UTF8_COLS_SLOTS];
+};
+
+Utf8Cols *utf8_cols_new(void) {
+    return calloc(1, sizeof(Utf8Cols));
+}
+
+void utf8_cols_free(Utf8Cols *cache) {
+    if (!cache) return;
+    for (int i = 0; i < UTF8_COLS_SLOTS; i++) free(cache->slot[i].col);
+    free(cache);
+}
+
+int utf8_cols_at(Utf8Cols *cache, int row, unsigned long gen,
+                 const char *text, int len, int at) {
+    if (at > len) at = len;
+    if (at <= 0) return 0;
+    if (!cache || gen == 0) return width_span(text, len, 0, at);
+
+    ColSlot *s = &cache->slot[(unsigned)row % UTF8_COLS_SLOTS];
+    if (s->gen != gen || s->row != row || s->text != text || s->len != len) {
+        s->row = row;
+        s->gen = gen;
+        s->text = text;
+        s->len = len;
+        s->ascii = utf8_ascii_len(text, len) == len;
+        s->valid = 1;
+        int need = len / UTF8_COLS_CHUNK + 1;
+        if (!s->ascii && need > s->cap) {
+            int *p = realloc(s->col, sizeof(int) * (size_t)need);
+            if (!p) {
+                perror("Out of memory");
+                exit(1);
+            }
+            s->col = p;
+            s->cap = need;
+        }
+        if (!s->ascii) s->col[0] = 0;
+    }
+    if (s->ascii) return at;
+
+    int k = at / UTF8_COLS_CHUNK;
+    while (s->valid <= k) {
+        int from = (s->valid - 1) * UTF8_COLS_CHUNK;
+        s->col[s->valid] = s->col[s->valid - 1] +
+                           width_span(text, len, from, from + UTF8_COLS_CHUNK);
+        s->valid++;
+    }
+    return s->col[k] + width_span(text, len, k * UTF8_COLS_CHUNK, at);
+}
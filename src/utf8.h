@@ -0,0 +1,61 @@
+/* utf8.h - Display width of UTF-8 text
+ *
+ * Render columns are bytes of a row's render (TABs expanded); the screen
+ * shows a UTF-8 character in its East Asian width: two cells for Wide and
+ * Fullwidth characters (CJK, most emoji), none for combining marks and
+ * other zero-width ones, one for the rest. A byte that starts no valid
+ * sequence takes one cell, as the terminal shows it; a stray continuation
+ * byte takes none.
+ *
+ * Runs of ASCII, which is most text, are skipped 16 bytes at a time with
+ * SSE2 (8 with word-at-a-time tests otherwise) and count a cell a byte.
+ * Rows with other text keep sparse checkpoints in a Utf8Cols cache: the
+ * cells before every UTF8_COLS_CHUNK bytes, so the cells before any byte
+ * take a lookup and a scan of less than a chunk.
+ */
+
+#ifndef LOKI_UTF8_H
+#define LOKI_UTF8_H
+
+/* Bytes between checkpoints of a row */
+#define UTF8_COLS_CHUNK 256
+
+/* Length of the run of ASCII bytes that s[0..len) starts with. */
+int utf8_ascii_len(const char *s, int len);
+
+/* Decode the character s[0..len) starts with (len >= 1). Sets *cp to its
+ * code point, or -1 if the bytes are no valid sequence; returns the bytes
+ * it takes (1 for an invalid one). */
+int utf8_decode(const char *s, int len, int *cp);
+
+/* Cells code point 'cp' takes on screen: 0, 1 or 2. */
+int utf8_cp_width(int cp);
+
+/* Cells s[0..len) takes. */
+int utf8_width(const char *s, int len);
+
+/* Bytes of s[0..len) that fit in 'cols' cells, not splitting a character;
+ * zero-width characters after the last one that fits go with it. */
+int utf8_fit(const char *s, int len, int cols);
+
+/* Is 'c' a continuation byte (inside a character)? */
+static inline int utf8_is_cont(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+typedef struct Utf8Cols Utf8Cols;
+
+/* Create an empty checkpoint cache. Returns NULL on out of memory. */
+Utf8Cols *utf8_cols_new(void);
+
+/* Release a cache. Safe on NULL. */
+void utf8_cols_free(Utf8Cols *cache);
+
+/* Cells text[0..at) takes, 'text' being the render of row 'row' as of
+ * change 'gen'. The checkpoints of a row are kept while row, gen, text
+ * and len stay the same; gen 0 (unknown) keeps none. A NULL cache only
+ * scans. */
+int utf8_cols_at(Utf8Cols *cache, int row, unsigned long gen,
+                 const char *text, int len, int at);
+
+#endif /* LOKI_UTF8_H */
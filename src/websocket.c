@@ -0,0 +1,518 @@
+/* websocket.c - WebSocket framing for the RPC server (RFC 6455, 7692)
+ *
+ * See websocket.h. Input is gathered until a frame is whole; the frames
+ * of a message are gathered until its last, then it is inflated if it
+ * was compressed and handed on. Pings are answered at once. Frames sent
+ * are never fragmented, and never masked, as a server's are not.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef LOKI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "websocket.h"
+#include "selection.h"      /* base64_encode_to() */
+
+/* Close codes */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+/* Bytes zlib is given or writes per call */
+#define WS_ZLIB_CHUNK 65536
+
+/* The trailer a sync flush ends with, left off compressed messages */
+static const char deflate_tail[4] = {0x00, 0x00, (char)0xff, (char)0xff};
+
+typedef struct WsBuf {
+    char *data;
+    size_t len, cap;
+} WsBuf;
+
+struct WsSocket {
+    WsCallbacks cb;
+    WsBuf in;               /* Input short of a whole frame */
+    WsBuf msg;              /* Frames of the message so far */
+    int msg_opcode;         /* Its opcode, or 0 between messages */
+    int msg_deflated;       /* It is compressed */
+    int last_opcode;
+    int closed;
+    int deflate;            /* permessage-deflate taken */
+    int no_context;         /* Reset the deflater after every message */
+    WsBuf frame;            /* Frame being sent */
+    WsBuf zout;             /* Compressed or inflated message */
+#ifdef LOKI_HAVE_ZLIB
+    z_stream zin, zdef;
+    int zin_ready, zdef_ready;
+#endif
+    WsStats stats;
+};
+
+static void buf_reserve(WsBuf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (data == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+static void buf_append(WsBuf *b, const void *data, size_t len) {
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* =============================== SHA-1 ================================== */
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t bytes;
+    unsigned char block[64];
+    size_t used;
+} Sha1;
+
+static uint32_t rol(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+static void sha1_block(Sha1 *s, const unsigned char *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) f = (b & c) | (~b & d), k = 0x5a827999;
+        else if (i < 40) f = b ^ c ^ d, k = 0x6ed9eba1;
+        else if (i < 60) f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+        else f = b ^ c ^ d, k = 0xca62c1d6;
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+}
+
+static void sha1_update(Sha1 *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->bytes += len;
+    while (len > 0) {
+        size_t n = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->block + s->used, p, n);
+        s->used += n;
+        p += n;
+        len -= n;
+        if (s->used == 64) {
+            sha1_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+static void sha1(const void *data, size_t len, unsigned char out[20]) {
+    Sha1 s = {{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0}, 0, {0}, 0};
+    sha1_update(&s, data, len);
+    uint64_t bits = s.bytes * 8;
+    unsigned char pad = 0x80, zero = 0, len_be[8];
+    sha1_update(&s, &pad, 1);
+    while (s.used != 56) sha1_update(&s, &zero, 1);
+    for (int i = 0; i < 8; i++) len_be[i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha1_update(&s, len_be, 8);
+    for (int i = 0; i < 20; i++) out[i] = (unsigned char)(s.h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+void ws_accept_key(const char *key, char out[29]) {
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char joined[128];
+    int len = snprintf(joined, sizeof(joined), "%s%s", key, guid);
+    unsigned char digest[20];
+    sha1(joined, (size_t)len < sizeof(joined) ? (size_t)len : sizeof(joined) - 1, digest);
+    out[base64_encode_to((const char *)digest, sizeof(digest), out)] = '\0';
+}
+
+/* ============================= Handshake ================================ */
+
+/* Whether the 'len' bytes at 's' hold 'word', ignoring case */
+static int has_word(const char *s, size_t len, const char *word) {
+    size_t n = strlen(word);
+    for (size_t i = 0; i + n <= len; i++) {
+        size_t j = 0;
+        while (j < n && tolower((unsigned char)s[i + j]) == word[j]) j++;
+        if (j == n) return 1;
+    }
+    return 0;
+}
+
+/* The 'len' bytes at 's' without the blanks around them */
+static void trim(const char **s, size_t *len) {
+    while (*len > 0 && isspace((unsigned char)**s)) (*s)++, (*len)--;
+    while (*len > 0 && isspace((unsigned char)(*s)[*len - 1])) (*len)--;
+}
+
+/* Take the first permessage-deflate offer of a Sec-WebSocket-Extensions
+ * value whose parameters can be met */
+static void take_deflate(WsRequest *req, const char *v, size_t len) {
+#ifdef LOKI_HAVE_ZLIB
+    while (len > 0 && !req->deflate) {
+        const char *comma = memchr(v, ',', len);
+        size_t n = comma ? (size_t)(comma - v) : len;
+        const char *offer = v;
+        v += comma ? n + 1 : n;
+        len -= comma ? n + 1 : n;
+
+        int ok = 1, no_context = 0, first = 1;
+        while (n > 0 && ok) {
+            const char *semi = memchr(offer, ';', n);
+            size_t m = semi ? (size_t)(semi - offer) : n;
+            const char *p = offer;
+            size_t plen = m;
+            offer += semi ? m + 1 : m;
+            n -= semi ? m + 1 : m;
+            trim(&p, &plen);
+            if (first) {
+                ok = plen == 18 && strncmp(p, "permessage-deflate", 18) == 0;
+                first = 0;
+            } else if (plen == 26 && strncmp(p, "server_no_context_takeover", 26) == 0) {
+                no_context = 1;
+            } else if (plen == 26 && strncmp(p, "client_no_context_takeover", 26) == 0) {
+                /* The client's own business */
+            } else if (plen >= 22 && strncmp(p, "client_max_window_bits", 22) == 0) {
+                /* Inflated with the largest window, which takes any */
+            } else if (plen >= 22 && strncmp(p, "server_max_window_bits", 22) == 0) {
+                const char *eq = memchr(p, '=', plen);
+                ok = eq && atoi(eq + 1) == 15;
+            } else {
+                ok = 0;
+            }
+        }
+        if (ok && !first) {
+            req->deflate = 1;
+            req->no_context = no_context;
+        }
+    }
+#else
+    (void)req;
+    (void)v;
+    (void)len;
+#endif
+}
+
+int ws_parse_request(const char *buf, size_t len, WsRequest *req) {
+    memset(req, 0, sizeof(*req));
+    size_t scan = len < WS_REQUEST_MAX ? len : WS_REQUEST_MAX;
+    size_t head = 0;
+    for (size_t i = 3; i < scan; i++) {
+        if (memcmp(buf + i - 3, "\r\n\r\n", 4) == 0) {
+            head = i + 1;
+            break;
+        }
+    }
+    if (len >= 4 && memcmp(buf, "GET ", 4) != 0) return -1;
+    if (head == 0) return len >= WS_REQUEST_MAX ? -1 : 0;
+
+    const char *path = buf + 4, *sp = memchr(path, ' ', head - 4);
+    if (sp == NULL) return -1;
+    snprintf(req->path, sizeof(req->path), "%.*s", (int)(sp - path), path);
+
+    int websocket = 0, version = 0;
+    const char *line = (const char *)memchr(buf, '\n', head) + 1;
+    while (line < buf + head) {
+        const char *eol = memchr(line, '\n', (size_t)(buf + head - line));
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        if (colon) {
+            size_t nlen = (size_t)(colon - line);
+            const char *v = colon + 1;
+            size_t vlen = (size_t)(eol - v);
+            trim(&v, &vlen);
+            if (nlen == 7 && strncasecmp(line, "Upgrade", 7) == 0) {
+                websocket = has_word(v, vlen, "websocket");
+            } else if (nlen == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0) {
+                snprintf(req->key, sizeof(req->key), "%.*s", (int)vlen, v);
+            } else if (nlen == 21 && strncasecmp(line, "Sec-WebSocket-Version", 21) == 0) {
+                version = atoi(v);
+            } else if (nlen == 24 && strncasecmp(line, "Sec-WebSocket-Extensions", 24) == 0) {
+                take_deflate(req, v, vlen);
+            }
+        }
+        line = eol + 1;
+    }
+    req->upgrade = websocket && version == 13 && req->key[0];
+    if (!req->upgrade) req->deflate = req->no_context = 0;
+    return (int)head;
+}
+
+size_t ws_handshake_response(const WsRequest *req, char *out) {
+    char accept[29];
+    ws_accept_key(req->key, accept);
+    int len = snprintf(out, WS_RESPONSE_MAX,
+                       "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: %s\r\n"
+                       "%s%s%s\r\n",
+                       accept,
+                       req->deflate ? "Sec-WebSocket-Extensions: permessage-deflate" : "",
+                       req->no_context ? "; server_no_context_takeover" : "",
+                       req->deflate ? "\r\n" : "");
+    return (size_t)len;
+}
+
+/* ============================== Frames ================================== */
+
+WsSocket *ws_new(const WsRequest *req, const WsCallbacks *cb) {
+    WsSocket *ws = calloc(1, sizeof(WsSocket));
+    if (ws == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    ws->cb = *cb;
+    ws->deflate = req->deflate;
+    ws->no_context = req->no_context;
+    ws->last_opcode = WS_TEXT;
+    return ws;
+}
+
+void ws_free(WsSocket *ws) {
+    if (ws == NULL) return;
+#ifdef LOKI_HAVE_ZLIB
+    if (ws->zin_ready) inflateEnd(&ws->zin);
+    if (ws->zdef_ready) deflateEnd(&ws->zdef);
+#endif
+    free(ws->in.data);
+    free(ws->msg.data);
+    free(ws->frame.data);
+    free(ws->zout.data);
+    free(ws);
+}
+
+/* Send one frame, unfragmented */
+static void send_frame(WsSocket *ws, int opcode, int rsv1, const char *data, size_t len) {
+    unsigned char head[10];
+    size_t n = 2;
+    head[0] = (unsigned char)(0x80 | (rsv1 ? 0x40 : 0) | opcode);
+    if (len < 126) {
+        head[1] = (unsigned char)len;
+    } else if (len <= 0xffff) {
+        head[1] = 126;
+        head[2] = (unsigned char)(len >> 8);
+        head[3] = (unsigned char)len;
+        n = 4;
+    } else {
+        head[1] = 127;
+        for (int i = 0; i < 8; i++) head[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+        n = 10;
+    }
+    ws->frame.len = 0;
+    buf_append(&ws->frame, head, n);
+    buf_append(&ws->frame, data, len);
+    ws->stats.wire_out += ws->frame.len;
+    ws->cb.write(ws->cb.opaque, ws->frame.data, ws->frame.len);
+}
+
+void ws_close(WsSocket *ws, int code) {
+    if (ws->closed) return;
+    ws->closed = 1;
+    char payload[2] = {(char)(code >> 8), (char)code};
+    send_frame(ws, WS_CLOSE, 0, payload, 2);
+}
+
+#ifdef LOKI_HAVE_ZLIB
+/* Compress 'len' bytes into ws->zout, without the sync flush trailer */
+static int deflate_message(WsSocket *ws, const char *data, size_t len) {
+    if (!ws->zdef_ready) {
+        if (deflateInit2(&ws->zdef, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        ws->zdef_ready = 1;
+    }
+    ws->zout.len = 0;
+    do {
+        size_t take = len < WS_ZLIB_CHUNK ? len : WS_ZLIB_CHUNK;
+        ws->zdef.next_in = (Bytef *)data;
+        ws->zdef.avail_in = (uInt)take;
+        data += take;
+        len -= take;
+        do {
+            buf_reserve(&ws->zout, WS_ZLIB_CHUNK);
+            ws->zdef.next_out = (Bytef *)ws->zout.data + ws->zout.len;
+            ws->zdef.avail_out = WS_ZLIB_CHUNK;
+            if (deflate(&ws->zdef, len > 0 ? Z_NO_FLUSH : Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                return -1;
+            ws->zout.len += WS_ZLIB_CHUNK - ws->zdef.avail_out;
+        } while (ws->zdef.avail_out == 0);
+    } while (len > 0);
+    if (ws->no_context) deflateReset(&ws->zdef);
+    if (ws->zout.len >= 4) ws->zout.len -= 4;      /* 00 00 ff ff */
+    return 0;
+}
+
+/* Inflate the message gathered into ws->zout. Returns 0, or -1 if it is
+ * corrupt or inflates past WS_MESSAGE_MAX. */
+static int inflate_message(WsSocket *ws) {
+    if (!ws->zin_ready) {
+        if (inflateInit2(&ws->zin, -15) != Z_OK) return -1;
+        ws->zin_ready = 1;
+    }
+    buf_append(&ws->msg, deflate_tail, sizeof(deflate_tail));
+    ws->zout.len = 0;
+    ws->zin.next_in = (Bytef *)ws->msg.data;
+    ws->zin.avail_in = (uInt)ws->msg.len;
+    do {
+        if (ws->zout.len >= WS_MESSAGE_MAX) return -1;
+        buf_reserve(&ws->zout, WS_ZLIB_CHUNK);
+        ws->zin.next_out = (Bytef *)ws->zout.data + ws->zout.len;
+        ws->zin.avail_out = WS_ZLIB_CHUNK;
+        int rc = inflate(&ws->zin, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return -1;
+        ws->zout.len += WS_ZLIB_CHUNK - ws->zin.avail_out;
+    } while (ws->zin.avail_out == 0);
+    return 0;
+}
+#endif
+
+void ws_send(WsSocket *ws, int opcode, const char *data, size_t len) {
+    if (ws->closed) return;
+    ws->stats.messages_out++;
+    ws->stats.bytes_out += len;
+#ifdef LOKI_HAVE_ZLIB
+    if (ws->deflate && len >= WS_DEFLATE_MIN && deflate_message(ws, data, len) == 0) {
+        send_frame(ws, opcode, 1, ws->zout.data, ws->zout.len);
+        return;
+    }
+#endif
+    send_frame(ws, opcode, 0, data, len);
+}
+
+/* The message gathered is whole: hand it on */
+static int deliver(WsSocket *ws) {
+    const char *data = ws->msg.data;
+    size_t len = ws->msg.len;
+    if (ws->msg_deflated) {
+#ifdef LOKI_HAVE_ZLIB
+        if (inflate_message(ws) == -1) return WS_CLOSE_TOO_BIG;
+        data = ws->zout.data;
+        len = ws->zout.len;
+#endif
+    }
+    int opcode = ws->msg_opcode;
+    ws->msg_opcode = 0;
+    ws->msg.len = 0;
+    ws->last_opcode = opcode;
+    ws->stats.messages_in++;
+    ws->stats.bytes_in += len;
+    ws->cb.message(ws->cb.opaque, opcode, data ? data : "", len);
+    return 0;
+}
+
+/* Handle the frame at 'buf' if the 'have' bytes there hold it whole.
+ * Returns its length, 0 if they do not, or minus a close code. */
+static long frame_step(WsSocket *ws, char *buf, size_t have) {
+    const unsigned char *p = (const unsigned char *)buf;
+    if (have < 2) return 0;
+
+    int fin = p[0] & 0x80, rsv1 = p[0] & 0x40, opcode = p[0] & 0x0f;
+    if ((p[0] & 0x30) || !(p[1] & 0x80)) return -WS_CLOSE_PROTOCOL;
+    uint64_t len = p[1] & 0x7f;
+    size_t head = 2;
+    if (len == 126) {
+        if (have < 4) return 0;
+        len = (uint64_t)p[2] << 8 | p[3];
+        head = 4;
+    } else if (len == 127) {
+        if (have < 10) return 0;
+        len = 0;
+        for (int i = 0; i < 8; i++) len = len << 8 | p[2 + i];
+        head = 10;
+    }
+    if (len > WS_MESSAGE_MAX || ws->msg.len + len > WS_MESSAGE_MAX) return -WS_CLOSE_TOO_BIG;
+    if (have < head + 4 + len) return 0;
+
+    /* Unmask in place */
+    const unsigned char *mask = p + head;
+    char *payload = buf + head + 4;
+    for (size_t i = 0; i < len; i++) payload[i] ^= (char)mask[i & 3];
+    long used = (long)(head + 4 + len);
+
+    if (opcode >= WS_CLOSE) {
+        if (!fin || len > 125 || rsv1) return -WS_CLOSE_PROTOCOL;
+        if (opcode == WS_PING) {
+            send_frame(ws, WS_PONG, 0, payload, (size_t)len);
+        } else if (opcode == WS_CLOSE) {
+            /* Answered with its code */
+            int code = len >= 2 ? ((unsigned char)payload[0] << 8 | (unsigned char)payload[1])
+                                : WS_CLOSE_NORMAL;
+            ws_close(ws, code);
+        } else if (opcode != WS_PONG) {
+            return -WS_CLOSE_PROTOCOL;
+        }
+        return used;
+    }
+
+    if (opcode == WS_CONTINUATION) {
+        if (ws->msg_opcode == 0 || rsv1) return -WS_CLOSE_PROTOCOL;
+    } else if (opcode == WS_TEXT || opcode == WS_BINARY) {
+        if (ws->msg_opcode != 0 || (rsv1 && !ws->deflate)) return -WS_CLOSE_PROTOCOL;
+        ws->msg_opcode = opcode;
+        ws->msg_deflated = rsv1 != 0;
+    } else {
+        return -WS_CLOSE_PROTOCOL;
+    }
+    buf_append(&ws->msg, payload, (size_t)len);
+    if (fin) {
+        int code = deliver(ws);
+        if (code) return -code;
+    }
+    return used;
+}
+
+int ws_feed(WsSocket *ws, const char *data, size_t len) {
+    if (ws->closed) return 1;
+    ws->stats.wire_in += len;
+    buf_append(&ws->in, data, len);
+
+    size_t off = 0;
+    while (!ws->closed) {
+        long n = frame_step(ws, ws->in.data + off, ws->in.len - off);
+        if (n == 0) break;
+        if (n < 0) {
+            ws_close(ws, (int)-n);
+            break;
+        }
+        off += (size_t)n;
+    }
+    /* Keep the start of a frame not yet whole */
+    if (ws->closed) off = ws->in.len;
+    memmove(ws->in.data, ws->in.data + off, ws->in.len - off);
+    ws->in.len -= off;
+    return ws->closed;
+}
+
+int ws_last_opcode(const WsSocket *ws) {
+    return ws->last_opcode;
+}
+
+void ws_stats(const WsSocket *ws, WsStats *out) {
+    *out = ws->stats;
+}
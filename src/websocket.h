@@ -0,0 +1,104 @@
+/* websocket.h - WebSocket framing for the RPC server (RFC 6455, 7692)
+ *
+ * rpc_server.c serves browsers on the socket other clients use: a
+ * connection whose first bytes are an HTTP GET asking for "Upgrade:
+ * websocket" gets the handshake answer, and is a WsSocket from then on.
+ * Its messages carry the protocol of jsonrpc.h as the socket would, so
+ * a browser sends a batch of the input of an animation frame with
+ * "render": true and "since" as one message, and gets one message back:
+ * the numbered frame after it, a delta of the last one (the rows that
+ * changed) in MessagePack or JSON. Replies are binary or text frames as
+ * the client's last message was.
+ *
+ * When the browser offers permessage-deflate and zlib was there at build
+ * time, messages of WS_DEFLATE_MIN bytes or more are compressed, each
+ * with the dictionary of those before it unless the client asked for
+ * server_no_context_takeover: successive frames, mostly the same rows,
+ * compress to a fraction of their size.
+ */
+
+#ifndef LOKI_WEBSOCKET_H
+#define LOKI_WEBSOCKET_H
+
+#include <stddef.h>
+
+/* Longest request head read, largest message taken, and the shortest
+ * message compressed */
+#define WS_REQUEST_MAX 8192
+#define WS_MESSAGE_MAX ((size_t)16 << 20)
+#define WS_DEFLATE_MIN 64
+
+/* Room for a handshake response */
+#define WS_RESPONSE_MAX 256
+
+/* Opcodes */
+enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+/* An HTTP request head, as far as serving it goes */
+typedef struct WsRequest {
+    char path[256];
+    int upgrade;            /* Asks for a WebSocket, with a key */
+    char key[64];           /* Sec-WebSocket-Key */
+    int deflate;            /* permessage-deflate offered, and taken */
+    int no_context;         /* ... with server_no_context_takeover */
+} WsRequest;
+
+typedef struct WsSocket WsSocket;
+
+typedef struct {
+    /* A whole message came: 'opcode' WS_TEXT or WS_BINARY */
+    void (*message)(void *opaque, int opcode, const char *data, size_t len);
+
+    /* Bytes to send the client: frames */
+    void (*write)(void *opaque, const char *data, size_t len);
+
+    void *opaque;
+} WsCallbacks;
+
+typedef struct WsStats {
+    unsigned long messages_in, messages_out;
+    unsigned long long bytes_in, bytes_out;     /* Of the messages */
+    unsigned long long wire_in, wire_out;       /* Of their frames */
+} WsStats;
+
+/* Parse the request head in the 'len' bytes at 'buf'. Returns its length
+ * (through the blank line), 0 while it is not all there, or -1 if it is
+ * not a GET request or longer than WS_REQUEST_MAX. */
+int ws_parse_request(const char *buf, size_t len, WsRequest *req);
+
+/* The 101 response accepting 'req' into 'out' (WS_RESPONSE_MAX bytes).
+ * Returns its length. */
+size_t ws_handshake_response(const WsRequest *req, char *out);
+
+/* Sec-WebSocket-Accept for 'key': 28 characters and a NUL */
+void ws_accept_key(const char *key, char out[29]);
+
+/* The connection after the handshake answering 'req' */
+WsSocket *ws_new(const WsRequest *req, const WsCallbacks *cb);
+
+void ws_free(WsSocket *ws);
+
+/* Decode the next 'len' bytes the client sent, which may end anywhere.
+ * Returns 0, or 1 once the connection is to be closed: the client closed
+ * it, or broke the protocol and was sent a close frame saying so. */
+int ws_feed(WsSocket *ws, const char *data, size_t len);
+
+/* Send 'len' bytes as one message (WS_TEXT or WS_BINARY) */
+void ws_send(WsSocket *ws, int opcode, const char *data, size_t len);
+
+/* Send a close frame with 'code' (1000: normal) */
+void ws_close(WsSocket *ws, int code);
+
+/* Opcode of the last message received (WS_TEXT before any) */
+int ws_last_opcode(const WsSocket *ws);
+
+void ws_stats(const WsSocket *ws, WsStats *out);
+
+#endif /* LOKI_WEBSOCKET_H */
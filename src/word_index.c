@@ -0,0 +1,589 @@
+/* word_index.c - Words of the open buffers, for keyword completion
+ *
+ * See word_index.h for an overview. A word has an id, its place in the
+ * entries of the table, for as long as the index lives: the words of a
+ * row are a list of ids, one per occurrence, and a word whose count falls
+ * to 0 keeps its entry (and id) but leaves the sorted words. A build
+ * fills a table of its own from a snapshot, and the change watch of the
+ * buffer, held meanwhile, has the edits made since for when it is put in
+ * place.
+ */
+
+#include "word_index.h"
+#include "changes.h"
+#include "completion.h"
+#include "model_snapshot.h"
+#include "task_pool.h"
+#include "buffers.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct WordEntry {
+    char *word;
+    uint32_t len;
+    uint32_t hash;
+    int count;                  /* Occurrences in the buffer */
+    unsigned stamp;             /* Query that last ranked it */
+    int dist;                   /* Rows from the cursor then (INT_MAX: far) */
+} WordEntry;
+
+typedef struct RowWords {
+    uint32_t *ids;              /* A word per occurrence, in order */
+    int n;
+} RowWords;
+
+typedef struct WordTable {
+    WordEntry *entries;
+    int nentries, entcap;
+    int32_t *slots;             /* Entry + 1, by hash; 0 empty */
+    uint32_t nslots;            /* A power of two */
+    CompletionIndex *sorted;    /* The words occurring */
+    RowWords *rows;
+    int nrows, rowcap;
+} WordTable;
+
+typedef struct WordBuild {
+    WordIndex *ix;              /* NULL once given up */
+    EditorSnapshot *snap;       /* Released by the build */
+    WordTable table;
+    TaskToken token;
+} WordBuild;
+
+struct WordIndex {
+    WordTable t;
+    int ready;                  /* 't' is built */
+    int stale;                  /* Out of step with the rows: built again */
+    int watch;                  /* Change watch of the buffer */
+    WordBuild *build;           /* In progress, or NULL */
+    unsigned stamp;
+};
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    return p;
+}
+
+/* ========================= Tables ========================= */
+
+static uint32_t word_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static int is_word_char(int c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static void table_free(WordTable *t) {
+    for (int i = 0; i < t->nentries; i++) free(t->entries[i].word);
+    for (int i = 0; i < t->nrows; i++) free(t->rows[i].ids);
+    free(t->entries);
+    free(t->slots);
+    free(t->rows);
+    completion_index_free(t->sorted);
+    memset(t, 0, sizeof(*t));
+}
+
+static int lookup(const WordTable *t, const char *word, size_t len, uint32_t hash) {
+    if (t->nslots == 0) return -1;
+    for (uint32_t i = hash & (t->nslots - 1);; i = (i + 1) & (t->nslots - 1)) {
+        int32_t slot = t->slots[i];
+        if (slot == 0) return -1;
+        const WordEntry *e = &t->entries[slot - 1];
+        if (e->hash == hash && e->len == len && memcmp(e->word, word, len) == 0)
+            return slot - 1;
+    }
+}
+
+static void slots_grow(WordTable *t) {
+    uint32_t nslots = t->nslots ? t->nslots * 2 : 1024;
+    int32_t *slots = calloc(nslots, sizeof(int32_t));
+    if (slots == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int id = 0; id < t->nentries; id++) {
+        uint32_t i = t->entries[id].hash & (nslots - 1);
+        while (slots[i]) i = (i + 1) & (nslots - 1);
+        slots[i] = id + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+}
+
+/* The id of the word, made if new (with a count of 0) */
+static uint32_t intern(WordTable *t, const char *word, size_t len) {
+    uint32_t hash = word_hash(word, len);
+    int id = lookup(t, word, len, hash);
+    if (id >= 0) return (uint32_t)id;
+
+    if ((uint32_t)(t->nentries + 1) * 2 > t->nslots) slots_grow(t);
+    if (t->nentries == t->entcap) {
+        t->entcap = t->entcap ? t->entcap * 2 : 256;
+        t->entries = xrealloc(t->entries, sizeof(WordEntry) * (size_t)t->entcap);
+    }
+    WordEntry *e = &t->entries[t->nentries];
+    memset(e, 0, sizeof(*e));
+    e->word = malloc(len + 1);
+    if (e->word == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(e->word, word, len);
+    e->word[len] = '\0';
+    e->len = (uint32_t)len;
+    e->hash = hash;
+    uint32_t i = hash & (t->nslots - 1);
+    while (t->slots[i]) i = (i + 1) & (t->nslots - 1);
+    t->slots[i] = t->nentries + 1;
+    return (uint32_t)t->nentries++;
+}
+
+/* The next word of the 'len' bytes at 's' from *pos on: a run of
+ * letters, digits and '_', not starting with a digit, of
+ * WORD_INDEX_MIN_LEN bytes up to COMPLETION_WORD_MAX. Returns 0 at the
+ * end. */
+static int next_word(const char *s, size_t len, size_t *pos, size_t *start,
+                     size_t *wlen) {
+    size_t i = *pos;
+    while (i < len) {
+        if (!is_word_char(s[i])) {
+            i++;
+            continue;
+        }
+        size_t from = i;
+        while (i < len && is_word_char(s[i])) i++;
+        if (isdigit((unsigned char)s[from]) || i - from < WORD_INDEX_MIN_LEN ||
+            i - from > COMPLETION_WORD_MAX)
+            continue;
+        *pos = i;
+        *start = from;
+        *wlen = i - from;
+        return 1;
+    }
+    *pos = i;
+    return 0;
+}
+
+/* Index the text of a row as 'rw' */
+static void row_fill(WordTable *t, RowWords *rw, const char *s, size_t len) {
+    size_t pos = 0, start, wlen;
+    int n = 0;
+    while (next_word(s, len, &pos, &start, &wlen)) n++;
+    rw->n = 0;
+    rw->ids = NULL;
+    if (n == 0) return;
+    rw->ids = malloc(sizeof(uint32_t) * (size_t)n);
+    if (rw->ids == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    pos = 0;
+    while (next_word(s, len, &pos, &start, &wlen)) {
+        uint32_t id = intern(t, s + start, wlen);
+        if (t->entries[id].count++ == 0)
+            completion_index_add(t->sorted, s + start, wlen, COMPLETION_SOURCE_WORDS);
+        rw->ids[rw->n++] = id;
+    }
+}
+
+static void row_drop(WordTable *t, RowWords *rw) {
+    for (int i = 0; i < rw->n; i++) {
+        WordEntry *e = &t->entries[rw->ids[i]];
+        if (--e->count == 0)
+            completion_index_remove(t->sorted, e->word, e->len, COMPLETION_SOURCE_WORDS);
+    }
+    free(rw->ids);
+    rw->ids = NULL;
+    rw->n = 0;
+}
+
+/* Rows row.. row + old_count - 1 of the table become new_count empty ones */
+static void rows_splice(WordTable *t, int row, int old_count, int new_count) {
+    for (int i = row; i < row + old_count; i++) row_drop(t, &t->rows[i]);
+    int nrows = t->nrows - old_count + new_count;
+    if (nrows > t->rowcap) {
+        t->rowcap = nrows > t->rowcap * 2 ? nrows : t->rowcap * 2;
+        t->rows = xrealloc(t->rows, sizeof(RowWords) * (size_t)t->rowcap);
+    }
+    memmove(&t->rows[row + new_count], &t->rows[row + old_count],
+            sizeof(RowWords) * (size_t)(t->nrows - row - old_count));
+    memset(&t->rows[row], 0, sizeof(RowWords) * (size_t)new_count);
+    t->nrows = nrows;
+}
+
+/* ========================= Builds ========================= */
+
+/* On the pool, or here: fill the build's table from its snapshot */
+static void build_run(void *arg) {
+    WordBuild *b = arg;
+    WordTable *t = &b->table;
+    int nrows = editor_snapshot_numrows(b->snap);
+    t->sorted = completion_index_new();
+    t->rows = calloc((size_t)(nrows ? nrows : 1), sizeof(RowWords));
+    if (t->rows == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    t->rowcap = nrows ? nrows : 1;
+    completion_index_begin(t->sorted, COMPLETION_SOURCE_WORDS);
+    for (int i = 0; i < nrows; i++) {
+        if ((i & 1023) == 0 && task_cancelled()) break;
+        size_t len;
+        const char *s = editor_snapshot_row(b->snap, i, &len);
+        row_fill(t, &t->rows[i], s, len);
+        t->nrows = i + 1;
+    }
+    completion_index_end(t->sorted, COMPLETION_SOURCE_WORDS);
+    editor_snapshot_release(b->snap);
+    b->snap = NULL;
+}
+
+static void build_free(WordBuild *b) {
+    editor_snapshot_release(b->snap);
+    table_free(&b->table);
+    free(b);
+}
+
+static void apply_batch(EditorModel *model, const ChangeRecord *records,
+                        int count, void *opaque);
+
+/* The build's table in place of the index's, with the edits since */
+static void install(WordIndex *ix, WordBuild *b) {
+    table_free(&ix->t);
+    ix->t = b->table;
+    memset(&b->table, 0, sizeof(b->table));
+    ix->ready = 1;
+    ix->stale = 0;
+    changes_hold(ix->watch, 0);
+    changes_deliver(ix->watch);
+}
+
+static void build_event_handler(AsyncEvent *event, void *unused) {
+    (void)unused;
+    WordBuild *b = event->data.user.ptr;
+    WordIndex *ix = b->ix;
+    if (ix) {
+        ix->build = NULL;
+        if (event->data.user.i64[0]) install(ix, b);
+    }
+    build_free(b);
+}
+
+void word_index_enable(editor_ctx_t *ctx) {
+    EditorModel *model = &ctx->model;
+    word_index_free(model);
+    if (model->lazy) return;
+
+    WordIndex *ix = calloc(1, sizeof(WordIndex));
+    WordBuild *b = calloc(1, sizeof(WordBuild));
+    if (ix == NULL || b == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    model->words = ix;
+    /* Edits from the snapshot on wait for the build */
+    ix->watch = changes_watch(model, 0, apply_batch, NULL, ix);
+    changes_hold(ix->watch, 1);
+    b->ix = ix;
+    b->snap = editor_model_snapshot(ctx);
+    task_token_init(&b->token);
+
+    if (model->numrows >= WORD_INDEX_ASYNC_ROWS) {
+        if (async_queue_get_handler(NULL, WORD_INDEX_ASYNC_EVENT) != build_event_handler) {
+            async_queue_set_handler(NULL, WORD_INDEX_ASYNC_EVENT, build_event_handler);
+            async_event_set_type_name(WORD_INDEX_ASYNC_EVENT, "words");
+        }
+        if (task_post(build_run, b, TASK_PRIORITY_LOW, &b->token,
+                      WORD_INDEX_ASYNC_EVENT) == 0) {
+            ix->build = b;
+            return;
+        }
+    }
+    build_run(b);       /* Short, or no pool: here, then */
+    install(ix, b);
+    build_free(b);
+}
+
+static void complete_forget(EditorModel *model);
+
+void word_index_free(EditorModel *model) {
+    complete_forget(model);
+    WordIndex *ix = model->words;
+    if (ix == NULL) return;
+    if (ix->build) {
+        /* It is freed when its event comes */
+        ix->build->ix = NULL;
+        task_token_cancel(&ix->build->token);
+    }
+    changes_unwatch(ix->watch);
+    table_free(&ix->t);
+    free(ix);
+    model->words = NULL;
+}
+
+int word_index_ready(const EditorModel *model) {
+    return model->words && model->words->ready && !model->words->stale;
+}
+
+/* ChangeFn of the index: the records' rows indexed again, top down */
+static void apply_batch(EditorModel *model, const ChangeRecord *records,
+                        int count, void *opaque) {
+    WordIndex *ix = opaque;
+    WordTable *t = &ix->t;
+    if (ix->stale) return;
+    for (int i = 0; i < count; i++) {
+        const ChangeRecord *r = &records[i];
+        if (r->old_count < 0 || r->row + r->old_count > t->nrows ||
+            r->row + r->new_count > model->numrows) {
+            ix->stale = 1;
+            return;
+        }
+        rows_splice(t, r->row, r->old_count, r->new_count);
+        for (int j = r->row; j < r->row + r->new_count; j++)
+            row_fill(t, &t->rows[j], model->row[j].chars, (size_t)model->row[j].size);
+    }
+    if (t->nrows != model->numrows) ix->stale = 1;
+}
+
+int word_index_count(EditorModel *model, const char *word, size_t len) {
+    WordIndex *ix = model->words;
+    if (ix == NULL || !ix->ready) return 0;
+    changes_deliver(ix->watch);
+    int id = lookup(&ix->t, word, len, word_hash(word, len));
+    return id < 0 ? 0 : ix->t.entries[id].count;
+}
+
+/* ========================= Queries ========================= */
+
+typedef struct Match {
+    const char *word;
+    uint32_t len;
+    long count;                 /* Occurrences in all the buffers */
+    int dist;                   /* Rows from the cursor (INT_MAX: far) */
+    const WordEntry *entry;     /* Its entry, while gathered */
+} Match;
+
+static int match_cmp_word(const void *a, const void *b) {
+    return strcmp(((const Match *)a)->word, ((const Match *)b)->word);
+}
+
+static int match_cmp_rank(const void *a, const void *b) {
+    const Match *x = a, *y = b;
+    if (x->dist != y->dist) return x->dist < y->dist ? -1 : 1;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return strcmp(x->word, y->word);
+}
+
+/* Add the words of 'ix' with the prefix to *m; those of the buffer
+ * being completed in get a distance. */
+static void gather(WordIndex *ix, const char *prefix, size_t len, int cursor_row,
+                   Match **m, int *n, int *cap) {
+    WordTable *t = &ix->t;
+    int first;
+    int run = completion_index_prefix(t->sorted, prefix, len, &first, NULL);
+    if (run == 0) return;
+    unsigned stamp = ++ix->stamp;
+    if (*n + run > *cap) {
+        *cap = *n + run > *cap * 2 ? *n + run : *cap * 2;
+        *m = xrealloc(*m, sizeof(Match) * (size_t)*cap);
+    }
+    int base = *n;
+    for (int i = first; i < first + run; i++) {
+        const char *word = completion_index_word(t->sorted, i);
+        size_t wlen = strlen(word);
+        int id = lookup(t, word, wlen, word_hash(word, wlen));
+        if (id < 0) continue;
+        WordEntry *e = &t->entries[id];
+        e->stamp = stamp;
+        e->dist = INT_MAX;
+        (*m)[(*n)++] = (Match){ e->word, e->len, e->count, INT_MAX, e };
+    }
+    if (cursor_row < 0) return;
+
+    /* The words of the rows around the cursor, not their text */
+    int lo = cursor_row - WORD_INDEX_NEAR, hi = cursor_row + WORD_INDEX_NEAR;
+    if (lo < 0) lo = 0;
+    if (hi > t->nrows - 1) hi = t->nrows - 1;
+    for (int r = lo; r <= hi; r++) {
+        int d = r < cursor_row ? cursor_row - r : r - cursor_row;
+        const RowWords *rw = &t->rows[r];
+        for (int k = 0; k < rw->n; k++) {
+            WordEntry *e = &t->entries[rw->ids[k]];
+            if (e->stamp == stamp && d < e->dist) e->dist = d;
+        }
+    }
+    for (int i = base; i < *n; i++) (*m)[i].dist = (*m)[i].entry->dist;
+}
+
+/* The index of 'model' brought up to date, or NULL if it has none ready */
+static WordIndex *usable(EditorModel *model) {
+    WordIndex *ix = model->words;
+    if (ix == NULL || !ix->ready) return NULL;
+    changes_deliver(ix->watch);
+    return ix->stale ? NULL : ix;
+}
+
+int word_index_query(editor_ctx_t *ctx, const char *prefix, size_t len,
+                     char **out, int max) {
+    /* The buffer completed in is indexed now if it is not yet */
+    if (ctx->model.words == NULL || ctx->model.words->stale) word_index_enable(ctx);
+
+    Match *m = NULL;
+    int n = 0, cap = 0;
+    WordIndex *own = usable(&ctx->model);
+    if (own) gather(own, prefix, len, ctx->view.rowoff + ctx->view.cy, &m, &n, &cap);
+
+    /* The other buffers: their words by how often they occur. A document
+     * in two views is one model. */
+    int nbuf = buffer_count();
+    const EditorModel **seen = malloc(sizeof(EditorModel *) * (size_t)(nbuf + 1));
+    if (seen == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int nseen = 0;
+    seen[nseen++] = &ctx->model;
+    for (int i = 0; i < nbuf; i++) {
+        const EditorView *view;
+        editor_ctx_t *other = buffer_peek(buffer_get_id_at(i), &view);
+        if (other == NULL) continue;
+        int dup = 0;
+        for (int j = 0; j < nseen && !dup; j++) dup = seen[j] == &other->model;
+        if (dup) continue;
+        seen[nseen++] = &other->model;
+        WordIndex *ix = usable(&other->model);
+        if (ix) gather(ix, prefix, len, -1, &m, &n, &cap);
+    }
+    free(seen);
+
+    /* One match per word: its counts added, its nearest distance */
+    int count = 0;
+    if (n > 0) {
+        qsort(m, (size_t)n, sizeof(Match), match_cmp_word);
+        for (int i = 0; i < n; i++) {
+            if (m[i].len == len) continue;      /* The prefix itself */
+            if (count > 0 && strcmp(m[count - 1].word, m[i].word) == 0) {
+                m[count - 1].count += m[i].count;
+                if (m[i].dist < m[count - 1].dist) m[count - 1].dist = m[i].dist;
+                continue;
+            }
+            m[count++] = m[i];
+        }
+        qsort(m, (size_t)count, sizeof(Match), match_cmp_rank);
+    }
+    if (count > max) count = max;
+    for (int i = 0; i < count; i++) {
+        out[i] = malloc(m[i].len + 1);
+        if (out[i] == NULL) {
+            perror("Out of memory");
+            exit(1);
+        }
+        memcpy(out[i], m[i].word, m[i].len + 1);
+    }
+    free(m);
+    return count;
+}
+
+/* ========================= Ctrl-N ========================= */
+
+static struct {
+    editor_ctx_t *ctx;          /* NULL: none under way */
+    int row, start;             /* Where the word starts */
+    size_t shown;               /* Bytes of it in the row now */
+    int dirty;                  /* model.dirty once it was put in */
+    char *typed;                /* The word as typed */
+    char *matches[WORD_INDEX_MAX_MATCHES];
+    int count;
+    int at;                     /* Match shown, -1 for 'typed' */
+} comp;
+
+void word_complete_end(void) {
+    if (comp.ctx == NULL) return;
+    for (int i = 0; i < comp.count; i++) free(comp.matches[i]);
+    free(comp.typed);
+    memset(&comp, 0, sizeof(comp));
+}
+
+/* A completion in the buffer going */
+static void complete_forget(EditorModel *model) {
+    if (comp.ctx && &comp.ctx->model == model) word_complete_end();
+}
+
+/* Put 'text' in place of the word shown */
+static void complete_show(editor_ctx_t *ctx, const char *text) {
+    size_t len = strlen(text);
+    int row, col;
+    editor_replace_range(ctx, comp.row, comp.start, comp.row,
+                         comp.start + (int)comp.shown, text, len, &row, &col);
+    editor_cursor_to(ctx, row, col);
+    comp.shown = len;
+    comp.dirty = ctx->model.dirty;
+}
+
+int word_complete_next(editor_ctx_t *ctx) {
+    int row = ctx->view.rowoff + ctx->view.cy;
+    int col = ctx->view.coloff + ctx->view.cx;
+
+    /* The last key was Ctrl-N here: the next match */
+    if (comp.ctx == ctx && comp.dirty == ctx->model.dirty && comp.row == row &&
+        comp.start + (int)comp.shown == col) {
+        comp.at = comp.at + 1 < comp.count ? comp.at + 1 : -1;
+        if (comp.at < 0) {
+            complete_show(ctx, comp.typed);
+            editor_set_status_msg(ctx, "Back at the word typed");
+        } else {
+            complete_show(ctx, comp.matches[comp.at]);
+            editor_set_status_msg(ctx, "Match %d of %d", comp.at + 1, comp.count);
+        }
+        return 1;
+    }
+
+    word_complete_end();
+    if (row >= ctx->model.numrows) return 0;
+    const t_erow *r = &ctx->model.row[row];
+    if (col > r->size) col = r->size;
+    int start = col;
+    while (start > 0 && is_word_char(r->chars[start - 1])) start--;
+    if (start == col) {
+        editor_set_status_msg(ctx, "No word before the cursor");
+        return 0;
+    }
+    size_t len = (size_t)(col - start);
+    char *typed = malloc(len + 1);
+    if (typed == NULL) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(typed, r->chars + start, len);
+    typed[len] = '\0';
+
+    int count = word_index_query(ctx, typed, len, comp.matches, WORD_INDEX_MAX_MATCHES);
+    if (count == 0) {
+        editor_set_status_msg(ctx, word_index_ready(&ctx->model) ?
+                              "No match for \"%s\"" : "No match for \"%s\" (still indexing)",
+                              typed);
+        free(typed);
+        return 0;
+    }
+    comp.ctx = ctx;
+    comp.row = row;
+    comp.start = start;
+    comp.shown = len;
+    comp.typed = typed;
+    comp.count = count;
+    comp.at = 0;
+    complete_show(ctx, comp.matches[0]);
+    editor_set_status_msg(ctx, "Match 1 of %d", count);
+    return 1;
+}
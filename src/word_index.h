@@ -0,0 +1,74 @@
+/* word_index.h - Words of the open buffers, for keyword completion
+ *
+ * Ctrl-N in INSERT mode completes the word before the cursor from the
+ * words of all the open buffers, as vim's does, without reading their
+ * rows. Each buffer keeps an index of its words, built on the task pool
+ * from a snapshot of its rows once it is loaded (model_snapshot.h), and
+ * kept up to date from its change records (changes.h), each record
+ * indexing again just the rows it covers. The index holds each word once
+ * in a hash table, with how many times it occurs; the words occurring,
+ * sorted, for prefix lookups (a CompletionIndex, completion.h); and the
+ * words of each row.
+ *
+ * A query takes the words with the prefix from each buffer's index, and
+ * ranks first those on the rows within WORD_INDEX_NEAR of the cursor,
+ * nearest first, found from the words of those rows rather than their
+ * text; then the others, those occurring most often in all the buffers
+ * first. Repeated, Ctrl-N puts in the next match, and after the last the
+ * word as it was typed.
+ */
+
+#ifndef LOKI_WORD_INDEX_H
+#define LOKI_WORD_INDEX_H
+
+#include <stddef.h>
+#include "internal.h"
+#include "async_queue.h"
+
+/* Shortest word indexed */
+#define WORD_INDEX_MIN_LEN 3
+
+/* Rows above and below the cursor whose words rank by nearness */
+#define WORD_INDEX_NEAR 100
+
+/* Buffers of this many rows or more are indexed on the pool */
+#define WORD_INDEX_ASYNC_ROWS 2000
+
+/* Matches Ctrl-N cycles through */
+#define WORD_INDEX_MAX_MATCHES 64
+
+/* A build on the pool finished */
+#define WORD_INDEX_ASYNC_EVENT (ASYNC_EVENT_USER + 11)
+
+typedef struct WordIndex WordIndex;
+
+/* Index the words of the buffer (again, if it already is). Buffers of
+ * WORD_INDEX_ASYNC_ROWS rows or more are indexed on the pool, and their
+ * index used once the build is done; buffers shown a window at a time
+ * are not indexed. */
+void word_index_enable(editor_ctx_t *ctx);
+
+/* Drop the buffer's index, giving up a build in progress */
+void word_index_free(EditorModel *model);
+
+/* Whether the index of the buffer is built */
+int word_index_ready(const EditorModel *model);
+
+/* Times 'word' occurs in the buffer, as indexed (0 if not indexed) */
+int word_index_count(EditorModel *model, const char *word, size_t len);
+
+/* Up to 'max' words of the open buffers starting with the 'len' bytes at
+ * 'prefix', ranked for the cursor of 'ctx' (see above), in 'out' as
+ * strings for the caller to free. The prefix itself is not one. Returns
+ * how many. */
+int word_index_query(editor_ctx_t *ctx, const char *prefix, size_t len,
+                     char **out, int max);
+
+/* Ctrl-N: complete the word before the cursor, or put in the next match
+ * if the last key did. Returns 1 if the text changed. */
+int word_complete_next(editor_ctx_t *ctx);
+
+/* Another key: Ctrl-N starts over next time */
+void word_complete_end(void);
+
+#endif /* LOKI_WORD_INDEX_H */
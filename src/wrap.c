@@ -0,0 +1,245 @@
+/* wrap.c - Soft wrap of rows to the width of the screen
+ *
+ * See wrap.h for an overview. The cache is an array of rows sorted by row
+ * number, searched by bisection; it only ever holds the rows shown lately,
+ * so moving the entries below an inserted or deleted row is cheap. Rows
+ * that fit in one screen row are not kept at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "wrap.h"
+
+#define TAB 9
+
+/* Rows kept at most; past that the cache starts over */
+#define WRAP_CACHE_MAX 1024
+
+typedef struct {
+    int row;
+    const char *chars;      /* What the breaks were laid out for */
+    int size;
+    int count;
+    int *starts;            /* count starts, then count widths */
+} WrapEntry;
+
+struct WrapCache {
+    WrapEntry *entry;
+    int count, cap;
+    int width;              /* Width of every entry */
+};
+
+/* Breaks of a row that fits: starts {0}, widths {width} */
+static int one_row[2];
+
+WrapCache *wrap_cache_new(void) {
+    return calloc(1, sizeof(WrapCache));
+}
+
+static void clear(WrapCache *cache) {
+    for (int i = 0; i < cache->count; i++) free(cache->entry[i].starts);
+    cache->count = 0;
+}
+
+void wrap_cache_free(WrapCache *cache) {
+    if (!cache) return;
+    clear(cache);
+    free(cache->entry);
+    free(cache);
+}
+
+int wrap_cached_rows(const WrapCache *cache) {
+    return cache ? cache->count : 0;
+}
+
+/* Index of the first entry at or after 'row' */
+static int lower_bound(const WrapCache *cache, int row) {
+    int lo = 0, hi = cache->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cache->entry[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Breaks laid out so far */
+typedef struct {
+    int *starts, *widths;
+    int count, cap;
+} Layout;
+
+static void push_break(Layout *l, int start, int width) {
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 8;
+        l->starts = realloc(l->starts, sizeof(int) * (size_t)l->cap);
+        l->widths = realloc(l->widths, sizeof(int) * (size_t)l->cap);
+        if (!l->starts || !l->widths) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    l->starts[l->count] = start;
+    l->widths[l->count++] = width;
+}
+
+/* Lay out the breaks of a row. Render columns are bytes of the render
+ * (TABs to the next stop, as in advance_col() of core.c), and screen rows
+ * are filled by cells (see utf8.h); a TAB counts as blanks. Sets *out to
+ * the starts followed by the widths, or NULL if the row fits. */
+static int layout(const char *chars, int size, int width, int **out) {
+    Layout l = { NULL, NULL, 0, 0 };
+    int start = 0, cell_start = 0;      /* Of the screen row being filled */
+    int blank_end = -1, blank_cell = 0; /* After its last blank */
+    int col = 0, cell = 0;
+    for (int j = 0; j < size; ) {
+        if (chars[j] == TAB) {
+            int end = col + 1;
+            while ((end + 1) % 8 != 0) end++;
+            for (; col < end; col++, cell++) {
+                if (cell - cell_start == width) {
+                    push_break(&l, start, cell - cell_start);
+                    start = col;
+                    cell_start = cell;
+                }
+                blank_end = col + 1;
+                blank_cell = cell + 1;
+            }
+            j++;
+            continue;
+        }
+
+        int cp, n = utf8_decode(chars + j, size - j, &cp);
+        int w = utf8_is_cont(chars[j]) ? 0 : utf8_cp_width(cp);
+        if (w > 0 && cell - cell_start + w > width && cell > cell_start) {
+            /* A blank right at the width needs no break before it */
+            if (chars[j] != ' ' && blank_cell > cell_start + width / 2) {
+                push_break(&l, start, blank_cell - cell_start);
+                start = blank_end;
+                cell_start = blank_cell;
+            } else {
+                push_break(&l, start, cell - cell_start);
+                start = col;
+                cell_start = cell;
+            }
+        }
+        col += n;
+        cell += w;
+        if (chars[j] == ' ') {
+            blank_end = col;
+            blank_cell = cell;
+        }
+        j += n;
+    }
+    if (l.count == 0) {
+        *out = NULL;
+        return 1;
+    }
+    push_break(&l, start, width);
+
+    /* One block: starts, then widths */
+    int *p = malloc(sizeof(int) * (size_t)l.count * 2);
+    if (!p) {
+        perror("Out of memory");
+        exit(1);
+    }
+    memcpy(p, l.starts, sizeof(int) * (size_t)l.count);
+    memcpy(p + l.count, l.widths, sizeof(int) * (size_t)l.count);
+    free(l.starts);
+    free(l.widths);
+    *out = p;
+    return l.count;
+}
+
+int wrap_row(WrapCache *cache, int row, const char *chars, int size,
+             int width, const int **starts, const int **widths) {
+    if (width < 1) width = 1;
+    one_row[0] = 0;
+    one_row[1] = width;
+    *starts = &one_row[0];
+    *widths = &one_row[1];
+    if (size <= width && !memchr(chars, TAB, (size_t)size)) return 1;
+
+    if (cache->width != width) {
+        clear(cache);
+        cache->width = width;
+    }
+    int i = lower_bound(cache, row);
+    WrapEntry *e = i < cache->count ? &cache->entry[i] : NULL;
+    if (e && e->row == row) {
+        if (e->chars != chars || e->size != size) {
+            /* Changed without a note: lay it out again */
+            free(e->starts);
+            e->chars = chars;
+            e->size = size;
+            e->count = layout(chars, size, width, &e->starts);
+        }
+    } else {
+        if (cache->count == WRAP_CACHE_MAX) {
+            clear(cache);
+            i = 0;
+        }
+        if (cache->count == cache->cap) {
+            int cap = cache->cap ? cache->cap * 2 : 64;
+            WrapEntry *p = realloc(cache->entry, sizeof(WrapEntry) * (size_t)cap);
+            if (!p) {
+                perror("Out of memory");
+                exit(1);
+            }
+            cache->entry = p;
+            cache->cap = cap;
+        }
+        memmove(cache->entry + i + 1, cache->entry + i,
+                sizeof(WrapEntry) * (size_t)(cache->count - i));
+        cache->count++;
+        e = &cache->entry[i];
+        e->row = row;
+        e->chars = chars;
+        e->size = size;
+        e->count = layout(chars, size, width, &e->starts);
+    }
+    if (e->starts) {
+        *starts = e->starts;
+        *widths = e->starts + e->count;
+    }
+    return e->count;
+}
+
+/* Drop the entry of 'at', if any, and move the rows below by 'delta' */
+static void note(WrapCache *cache, int at, int delta) {
+    if (!cache) return;
+    int i = lower_bound(cache, at);
+    if (i < cache->count && cache->entry[i].row == at && delta <= 0) {
+        free(cache->entry[i].starts);
+        memmove(cache->entry + i, cache->entry + i + 1,
+                sizeof(WrapEntry) * (size_t)(cache->count - i - 1));
+        cache->count--;
+    }
+    if (delta == 0) return;
+    for (; i < cache->count; i++) cache->entry[i].row += delta;
+}
+
+void wrap_note_insert(WrapCache *cache, int at) {
+    note(cache, at, 1);
+}
+
+void wrap_note_delete(WrapCache *cache, int at) {
+    note(cache, at, -1);
+}
+
+void wrap_note_change(WrapCache *cache, int at) {
+    note(cache, at, 0);
+}
+
+void wrap_note_delete_rows(WrapCache *cache, int at, int n) {
+    if (!cache || n <= 0) return;
+    int i = lower_bound(cache, at), j = lower_bound(cache, at + n);
+    for (int k = i; k < j; k++) free(cache->entry[k].starts);
+    memmove(cache->entry + i, cache->entry + j,
+            sizeof(WrapEntry) * (size_t)(cache->count - j));
+    cache->count -= j - i;
+    for (; i < cache->count; i++) cache->entry[i].row -= n;
+}
@@ -0,0 +1,45 @@
+/* wrap.h - Soft wrap of rows to the width of the screen
+ *
+ * With word wrap on, a row wider than the text area is shown on several
+ * screen rows: each is broken after its last blank if that leaves it at
+ * least half full, else right at the width, counted in cells (utf8.h). A
+ * row's breaks are the render columns its screen rows start at.
+ *
+ * The breaks are laid out per row when the row is first shown (or scrolled
+ * past) at a width and cached by row number; an edit drops the breaks of
+ * the rows it changed and moves those of the rows below
+ * (wrap_note_insert() and friends), and a new width drops them all. A
+ * frame asks for the rows it shows and no others, so nothing ever lays out
+ * the whole file, and a frame whose rows did not change lays out nothing.
+ */
+
+#ifndef LOKI_WRAP_H
+#define LOKI_WRAP_H
+
+typedef struct WrapCache WrapCache;
+
+/* Create an empty cache. Returns NULL on out of memory. */
+WrapCache *wrap_cache_new(void);
+
+/* Release a cache. Safe on NULL. */
+void wrap_cache_free(WrapCache *cache);
+
+/* Screen rows of row 'row', whose text is chars[0..size), wrapped at
+ * 'width' cells (>= 1). Sets *starts to the render column each screen
+ * row starts at (starts[0] is 0), and *widths to the cells of text on
+ * each, 'width' for the last; both valid until the next call. */
+int wrap_row(WrapCache *cache, int row, const char *chars, int size,
+             int width, const int **starts, const int **widths);
+
+/* Row 'at' was inserted, deleted, or had its text changed. */
+void wrap_note_insert(WrapCache *cache, int at);
+void wrap_note_delete(WrapCache *cache, int at);
+void wrap_note_change(WrapCache *cache, int at);
+
+/* Rows at..at+n-1 were deleted. */
+void wrap_note_delete_rows(WrapCache *cache, int at, int n);
+
+/* Rows whose breaks are cached (for tests). */
+int wrap_cached_rows(const WrapCache *cache);
+
+#endif /* LOKI_WRAP_H */
@@ -0,0 +1,471 @@
+/**
+ * @file bench_core.c
+ * @brief Core editing microbenchmarks, reported as JSON.
+ *
+ * Not run by ctest. For buffers of 10^3 rows, then ten times more up to
+ * the -m limit (10^6 by default; 10^7 rows take a few GB), times:
+ *
+ *   - insert_char_{start,middle,end}: editor_insert_char() typing on the
+ *     first, middle and last row
+ *   - newline_{start,middle,end}: editor_insert_newline() there
+ *   - del_row_top: editor_del_row() of the second row
+ *   - open, save: editor_open() of the buffer written as a file, and
+ *     editor_save() of it (per byte rather than per operation)
+ *   - snapshot_text: the buffer as one string (editor_model_snapshot()
+ *     and editor_snapshot_text())
+ *   - undo, redo: undo_perform() then redo_perform() through a history of
+ *     BENCH_HISTORY typed groups
+ *
+ * and reports for each the time per operation (the best of the passes),
+ * the row allocations per operation and the process's peak RSS so far.
+ * Where the hardware counters can be read (bench_counters.h), the cycles,
+ * instructions, cache misses and branch misses per operation of the same
+ * pass come with it; "counters" at the top says which are counted, or why
+ * none are.
+ * With -c, the report is compared with a baseline saved from an earlier
+ * run: the results more than -t percent (default 10) slower than the
+ * same result there are listed on stderr, and the exit status is 2.
+ *
+ *   bench_core [-n passes] [-m max_rows] [-c baseline.json] [-t percent]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "internal.h"
+#include "undo.h"
+#include "model_snapshot.h"
+#include "json.h"
+#include "bench_counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <uv.h>
+
+#define BENCH_PASSES 3
+#define BENCH_MIN_ROWS 1000
+#define BENCH_MAX_ROWS 1000000
+#define BENCH_OPS 1000          /* Edits timed per pass */
+#define BENCH_HISTORY 10000     /* Undo groups */
+#define BENCH_TOLERANCE 10      /* Percent slower that counts as a regression */
+#define BENCH_MAX_RESULTS 256
+#define BENCH_FILE "/tmp/loki_bench_core.txt"
+
+typedef struct BenchResult {
+    const char *name;
+    int rows;
+    int ops;
+    uint64_t ns;                /* Best pass */
+    unsigned long allocs;       /* Over all passes */
+    int passes;
+    long peak_rss_kb;
+    BenchCounts counts;         /* Of the best pass */
+} BenchResult;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int nresults;
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return ru.ru_maxrss;        /* Kilobytes on Linux */
+}
+
+static unsigned long row_allocs(const editor_ctx_t *ctx) {
+    const EditorAllocStats *s = &ctx->model.alloc_stats;
+    return s->row_array + s->chars + s->render + s->hl;
+}
+
+static BenchResult *add_result(const char *name, int rows, int ops, int passes) {
+    if (nresults == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "Too many results\n");
+        exit(1);
+    }
+    BenchResult *r = &results[nresults++];
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->rows = rows;
+    r->ops = ops;
+    r->passes = passes;
+    r->ns = UINT64_MAX;
+    return r;
+}
+
+/* Hardware counts of the timed sections since the last note_pass() */
+static BenchCounts pass_counts;
+
+static uint64_t timer_start(void) {
+    bench_counters_start();
+    return uv_hrtime();
+}
+
+static uint64_t timer_ns(uint64_t start) {
+    uint64_t ns = uv_hrtime() - start;
+    bench_counters_stop(&pass_counts);
+    return ns;
+}
+
+static void note_pass(BenchResult *r, uint64_t ns) {
+    if (ns < r->ns) {
+        r->ns = ns;
+        r->counts = pass_counts;
+    }
+    memset(&pass_counts, 0, sizeof(pass_counts));
+    r->peak_rss_kb = peak_rss_kb();
+}
+
+/* A line of typical code, different on every row */
+static int sample_line(char *line, size_t size, int n) {
+    return snprintf(line, size, "    result_%d = compute(\"text %d\", %d.5, other); "
+                    "// note %d", n, n, n % 1000, n);
+}
+
+static void init_ctx(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+}
+
+static void fill(editor_ctx_t *ctx, int rows) {
+    char line[128];
+    for (int r = 0; r < rows; r++) {
+        int len = sample_line(line, sizeof(line), r);
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+}
+
+/* Put the cursor on 'row', at column 'col' (clamped to its length) */
+static void place(editor_ctx_t *ctx, int row, int col) {
+    t_erow *r = &ctx->model.row[row];
+    if (col > r->size) col = r->size;
+    ctx->view.rowoff = row;
+    ctx->view.cy = 0;
+    ctx->view.coloff = col;
+    ctx->view.cx = 0;
+}
+
+enum { AT_START, AT_MIDDLE, AT_END };
+
+static int row_at(const editor_ctx_t *ctx, int where) {
+    if (where == AT_START) return 0;
+    if (where == AT_MIDDLE) return ctx->model.numrows / 2;
+    return ctx->model.numrows - 1;
+}
+
+static void bench_insert_char(editor_ctx_t *ctx, int rows, int where,
+                              const char *name, int passes) {
+    BenchResult *r = add_result(name, rows, BENCH_OPS, passes);
+    unsigned long allocs = row_allocs(ctx);
+    for (int p = 0; p < passes; p++) {
+        int row = row_at(ctx, where);
+        place(ctx, row, ctx->model.row[row].size / 2);
+        uint64_t start = timer_start();
+        for (int i = 0; i < BENCH_OPS; i++) editor_insert_char(ctx, 'a' + i % 26);
+        note_pass(r, timer_ns(start));
+        undo_break_group(ctx);
+    }
+    r->allocs = row_allocs(ctx) - allocs;
+}
+
+static void bench_newline(editor_ctx_t *ctx, int rows, int where,
+                          const char *name, int passes) {
+    BenchResult *r = add_result(name, rows, BENCH_OPS, passes);
+    unsigned long allocs = row_allocs(ctx);
+    for (int p = 0; p < passes; p++) {
+        uint64_t ns = 0;
+        for (int i = 0; i < BENCH_OPS; i++) {
+            int row = row_at(ctx, where);
+            place(ctx, row, ctx->model.row[row].size / 2);
+            uint64_t start = timer_start();
+            editor_insert_newline(ctx);
+            ns += timer_ns(start);
+        }
+        note_pass(r, ns);
+        undo_break_group(ctx);
+    }
+    r->allocs = row_allocs(ctx) - allocs;
+}
+
+static void bench_del_row(editor_ctx_t *ctx, int rows, int passes) {
+    BenchResult *r = add_result("del_row_top", rows, BENCH_OPS, passes);
+    unsigned long allocs = row_allocs(ctx);
+    char line[128];
+    for (int p = 0; p < passes; p++) {
+        uint64_t start = timer_start();
+        for (int i = 0; i < BENCH_OPS && ctx->model.numrows > 2; i++)
+            editor_del_row(ctx, 1);
+        note_pass(r, timer_ns(start));
+        /* Back to the size measured */
+        for (int i = 0; i < BENCH_OPS; i++) {
+            int len = sample_line(line, sizeof(line), i);
+            editor_insert_row(ctx, 1, line, (size_t)len);
+        }
+    }
+    r->allocs = row_allocs(ctx) - allocs;
+}
+
+static void bench_snapshot_text(editor_ctx_t *ctx, int rows, int passes) {
+    BenchResult *r = add_result("snapshot_text", rows, 1, passes);
+    for (int p = 0; p < passes; p++) {
+        editor_snapshot_note_change(&ctx->model);
+        uint64_t start = timer_start();
+        EditorSnapshot *snap = editor_model_snapshot(ctx);
+        size_t len;
+        char *text = snap ? editor_snapshot_text(snap, &len) : NULL;
+        note_pass(r, timer_ns(start));
+        if (!text) {
+            perror("Out of memory");
+            exit(1);
+        }
+        free(text);
+        editor_snapshot_release(snap);
+    }
+}
+
+static long file_size(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+/* editor_open() and editor_save() per byte of the file */
+static void bench_open_save(editor_ctx_t *ctx, int rows, int passes) {
+    char path[] = BENCH_FILE;
+    free(ctx->model.filename);
+    ctx->model.filename = strdup(path);
+    if (!ctx->model.filename || editor_save(ctx) != 0) {
+        perror(path);
+        exit(1);
+    }
+    int bytes = (int)file_size(path);
+
+    BenchResult *open = add_result("open", rows, bytes, passes);
+    BenchResult *save = add_result("save", rows, bytes, passes);
+    for (int p = 0; p < passes; p++) {
+        editor_ctx_t other;
+        init_ctx(&other);
+        uint64_t start = timer_start();
+        if (editor_open(&other, path) != 0) {
+            perror(path);
+            exit(1);
+        }
+        note_pass(open, timer_ns(start));
+        open->allocs += row_allocs(&other);
+
+        unsigned long allocs = row_allocs(&other);
+        other.model.dirty = 1;
+        start = timer_start();
+        if (editor_save(&other) != 0) {
+            perror(path);
+            exit(1);
+        }
+        note_pass(save, timer_ns(start));
+        save->allocs += row_allocs(&other) - allocs;
+        editor_ctx_free(&other);
+    }
+    unlink(path);
+}
+
+/* A history of BENCH_HISTORY groups of typing, undone then redone */
+static void bench_undo_redo(int rows, int passes) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    fill(&ctx, rows);
+    undo_free(&ctx);
+    undo_init(&ctx, BENCH_HISTORY * 4, (size_t)1 << 30);
+    for (int g = 0; g < BENCH_HISTORY; g++) {
+        place(&ctx, (int)((long long)g * 7919 % rows), 4);
+        for (const char *s = "value_"; *s; s++) editor_insert_char(&ctx, *s);
+        undo_break_group(&ctx);
+    }
+
+    BenchResult *undo = add_result("undo", rows, BENCH_HISTORY, passes);
+    BenchResult *redo = add_result("redo", rows, BENCH_HISTORY, passes);
+    unsigned long allocs = row_allocs(&ctx);
+    for (int p = 0; p < passes; p++) {
+        uint64_t start = timer_start();
+        int n = 0;
+        while (n < BENCH_HISTORY && undo_perform(&ctx)) n++;
+        note_pass(undo, timer_ns(start));
+        undo->allocs += row_allocs(&ctx) - allocs;
+        allocs = row_allocs(&ctx);
+
+        start = timer_start();
+        while (n-- > 0 && redo_perform(&ctx)) {}
+        note_pass(redo, timer_ns(start));
+        redo->allocs += row_allocs(&ctx) - allocs;
+        allocs = row_allocs(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+static void bench_size(int rows, int passes) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    fill(&ctx, rows);
+
+    bench_insert_char(&ctx, rows, AT_START, "insert_char_start", passes);
+    bench_insert_char(&ctx, rows, AT_MIDDLE, "insert_char_middle", passes);
+    bench_insert_char(&ctx, rows, AT_END, "insert_char_end", passes);
+    bench_newline(&ctx, rows, AT_START, "newline_start", passes);
+    bench_newline(&ctx, rows, AT_MIDDLE, "newline_middle", passes);
+    bench_newline(&ctx, rows, AT_END, "newline_end", passes);
+    bench_del_row(&ctx, rows, passes);
+    bench_snapshot_text(&ctx, rows, passes);
+    bench_open_save(&ctx, rows, passes);
+    editor_ctx_free(&ctx);
+
+    bench_undo_redo(rows, passes);
+}
+
+static double ns_per_op(const BenchResult *r) {
+    return r->ops ? (double)r->ns / (double)r->ops : 0;
+}
+
+static void report(JsonBuilder *jb, const BenchResult *r) {
+    json_object_start(jb);
+    json_kv_string(jb, "name", r->name);
+    json_kv_int(jb, "rows", r->rows);
+    json_kv_int(jb, "ops", r->ops);
+    json_kv_double(jb, "ns_per_op", ns_per_op(r));
+    /* Integer picoseconds too, for the baseline comparison (the JSON
+     * reader keeps integers only) */
+    json_kv_int(jb, "ps_per_op", (int)(ns_per_op(r) * 1000 < 2e9 ?
+                                       ns_per_op(r) * 1000 : 2e9));
+    json_kv_double(jb, "allocs_per_op", r->ops && r->passes ?
+                   (double)r->allocs / r->ops / r->passes : 0);
+    json_kv_int(jb, "peak_rss_kb", (int)r->peak_rss_kb);
+    bench_counters_json(jb, &r->counts, r->ops, "op");
+    json_object_end(jb);
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    size_t cap = 4096, n = 0;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf && (got = fread(buf + n, 1, cap - n, fp)) > 0) {
+        n += got;
+        if (n == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    fclose(fp);
+    *len = n;
+    return buf;
+}
+
+/* Compare with the report at 'path'. Returns the number of regressions,
+ * or -1 if the baseline can't be read. */
+static int compare(const char *path, int tolerance) {
+    size_t len;
+    char *text = read_file(path, &len);
+    if (!text) {
+        perror(path);
+        return -1;
+    }
+    JsonDoc doc;
+    int failed = json_doc_parse(&doc, text, len);
+    free(text);
+    if (failed) {
+        json_doc_free(&doc);
+        fprintf(stderr, "%s: not a bench_core report\n", path);
+        return -1;
+    }
+    const JsonValue *list = json_object_get(&doc.root, "results");
+    int regressions = 0;
+    for (int i = 0; i < nresults; i++) {
+        const BenchResult *r = &results[i];
+        long long now = (long long)(ns_per_op(r) * 1000);
+        for (size_t j = 0; list && list->type == JSON_ARRAY &&
+                           j < list->data.array_val.count; j++) {
+            const JsonValue *b = &list->data.array_val.items[j];
+            const char *name = json_object_get_string(b, "name");
+            if (!name || strcmp(name, r->name) != 0 ||
+                json_object_get_int(b, "rows", -1) != r->rows)
+                continue;
+            long long base = json_object_get_int(b, "ps_per_op", 0);
+            if (base > 0 && now * 100 > base * (100 + tolerance)) {
+                fprintf(stderr, "%s (%d rows): %.1f ns/op, was %.1f (+%lld%%)\n",
+                        r->name, r->rows, now / 1000.0, base / 1000.0,
+                        (now - base) * 100 / base);
+                regressions++;
+            }
+            break;
+        }
+    }
+    json_doc_free(&doc);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    int max_rows = BENCH_MAX_ROWS;
+    int tolerance = BENCH_TOLERANCE;
+    const char *baseline = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            passes = atoi(argv[i + 1]);
+            if (passes < 1) passes = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            max_rows = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            baseline = argv[i + 1];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            tolerance = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s [-n passes] [-m max_rows] [-c baseline.json] "
+                "[-t percent]\n", argv[0]);
+        return 1;
+    }
+
+    bench_counters_open();
+    for (long long rows = BENCH_MIN_ROWS; rows <= max_rows; rows *= 10)
+        bench_size((int)rows, passes);
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "passes", passes);
+    json_kv_string(&jb, "counters", bench_counters_status());
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+    for (int i = 0; i < nresults; i++) report(&jb, &results[i]);
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    bench_counters_close();
+
+    if (baseline) {
+        int regressions = compare(baseline, tolerance);
+        if (regressions < 0) return 1;
+        if (regressions > 0) {
+            fprintf(stderr, "%d results more than %d%% slower than %s\n",
+                    regressions, tolerance, baseline);
+            return 2;
+        }
+    }
+    return 0;
+}
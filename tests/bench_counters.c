@@ -0,0 +1,153 @@
+/**
+ * @file bench_counters.c
+ * @brief Hardware performance counters for the benchmarks.
+ *
+ * See bench_counters.h for an overview.
+ */
+
+#define _GNU_SOURCE
+
+#include "bench_counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static const char *counter_names[BENCH_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+/* What a counter reads, with PERF_FORMAT_TOTAL_TIME_ENABLED/RUNNING */
+typedef struct CounterReading {
+    uint64_t value;
+    uint64_t enabled;
+    uint64_t running;
+} CounterReading;
+
+static int fds[BENCH_COUNTERS] = {-1, -1, -1, -1};
+static CounterReading started[BENCH_COUNTERS];
+static char status[128] = "not opened";
+
+#ifdef __linux__
+static const uint64_t counter_configs[BENCH_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    /* User space only: allowed at the default perf_event_paranoid of 2 */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int read_counter(int fd, CounterReading *r) {
+    return read(fd, r, sizeof(*r)) == (ssize_t)sizeof(*r) ? 0 : -1;
+}
+#endif
+
+int bench_counters_open(void) {
+    bench_counters_close();
+    const char *env = getenv("LOKI_BENCH_COUNTERS");
+    if (env && strcmp(env, "0") == 0) {
+        snprintf(status, sizeof(status), "unavailable: LOKI_BENCH_COUNTERS=0");
+        return 0;
+    }
+#ifdef __linux__
+    int opened = 0, err = 0;
+    for (int c = 0; c < BENCH_COUNTERS; c++) {
+        fds[c] = open_counter(counter_configs[c]);
+        if (fds[c] >= 0) opened++;
+        else err = errno;
+    }
+    if (!opened) {
+        snprintf(status, sizeof(status), "unavailable: perf_event_open: %s",
+                 strerror(err));
+        return 0;
+    }
+    size_t len = 0;
+    status[0] = '\0';
+    for (int c = 0; c < BENCH_COUNTERS; c++) {
+        if (fds[c] < 0) continue;
+        int n = snprintf(status + len, sizeof(status) - len, "%s%s",
+                         len ? "," : "", counter_names[c]);
+        if (n > 0 && (size_t)n < sizeof(status) - len) len += (size_t)n;
+        ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return opened;
+#else
+    snprintf(status, sizeof(status), "unavailable: not Linux");
+    return 0;
+#endif
+}
+
+void bench_counters_close(void) {
+    for (int c = 0; c < BENCH_COUNTERS; c++) {
+#ifdef __linux__
+        if (fds[c] >= 0) close(fds[c]);
+#endif
+        fds[c] = -1;
+    }
+    snprintf(status, sizeof(status), "not opened");
+}
+
+void bench_counters_start(void) {
+#ifdef __linux__
+    for (int c = 0; c < BENCH_COUNTERS; c++)
+        if (fds[c] >= 0 && read_counter(fds[c], &started[c]) != 0)
+            memset(&started[c], 0, sizeof(started[c]));
+#endif
+}
+
+void bench_counters_stop(BenchCounts *counts) {
+#ifdef __linux__
+    for (int c = 0; c < BENCH_COUNTERS; c++) {
+        CounterReading now;
+        if (fds[c] < 0 || read_counter(fds[c], &now) != 0) continue;
+        uint64_t value = now.value - started[c].value;
+        uint64_t enabled = now.enabled - started[c].enabled;
+        uint64_t running = now.running - started[c].running;
+        /* Switched out part of the time: scale up to all of it */
+        if (running && running < enabled)
+            value = (uint64_t)((double)value * (double)enabled / (double)running);
+        counts->value[c] += value;
+    }
+#else
+    (void)counts;
+#endif
+}
+
+const char *bench_counters_status(void) {
+    return status;
+}
+
+void bench_counters_json(JsonBuilder *jb, const BenchCounts *counts,
+                         double ops, const char *unit) {
+    if (ops <= 0) return;
+    for (int c = 0; c < BENCH_COUNTERS; c++) {
+        if (fds[c] < 0) continue;
+        char key[64];
+        snprintf(key, sizeof(key), "%s_per_%s", counter_names[c], unit);
+        json_kv_double(jb, key, (double)counts->value[c] / ops);
+    }
+    if (fds[BENCH_CYCLES] >= 0 && fds[BENCH_INSTRUCTIONS] >= 0 &&
+        counts->value[BENCH_CYCLES])
+        json_kv_double(jb, "ipc", (double)counts->value[BENCH_INSTRUCTIONS] /
+                       (double)counts->value[BENCH_CYCLES]);
+}
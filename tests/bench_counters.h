@@ -0,0 +1,56 @@
+/**
+ * @file bench_counters.h
+ * @brief Hardware performance counters for the benchmarks (Linux).
+ *
+ * Counts CPU cycles, instructions retired, cache misses and branch misses
+ * in user space over the timed part of a benchmark, through
+ * perf_event_open(2), so a change can be judged on what it does to the
+ * cache and the branch predictor as well as on wall time. Each counter is
+ * opened on its own: one the CPU or the VM lacks is left out rather than
+ * taking the others with it. Counts are scaled up for the time the kernel
+ * had a counter switched out (multiplexed).
+ *
+ * Where nothing can be counted (not Linux, perf_event_paranoid above 2,
+ * a container without the syscall) the benchmarks run as before and say
+ * why in their report. LOKI_BENCH_COUNTERS=0 turns the counters off.
+ */
+
+#ifndef LOKI_BENCH_COUNTERS_H
+#define LOKI_BENCH_COUNTERS_H
+
+#include "json.h"
+#include <stdint.h>
+
+enum {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_CACHE_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_COUNTERS
+};
+
+typedef struct BenchCounts {
+    uint64_t value[BENCH_COUNTERS];
+} BenchCounts;
+
+/* Open the counters. Returns the number opened: 0 when none could be, see
+ * bench_counters_status(). */
+int bench_counters_open(void);
+
+/* Close them again */
+void bench_counters_close(void);
+
+/* Start counting; bench_counters_stop() adds what was counted since to
+ * 'counts'. Both do nothing with no counter open. */
+void bench_counters_start(void);
+void bench_counters_stop(BenchCounts *counts);
+
+/* "cycles,instructions,..." for the counters open, or why there are none */
+const char *bench_counters_status(void);
+
+/* Add "<counter>_per_<unit>" for each counter open, 'counts' divided by
+ * 'ops', and "ipc" with cycles and instructions both open */
+void bench_counters_json(JsonBuilder *jb, const BenchCounts *counts,
+                         double ops, const char *unit);
+
+#endif /* LOKI_BENCH_COUNTERS_H */
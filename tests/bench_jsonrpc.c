@@ -0,0 +1,153 @@
+/**
+ * @file bench_jsonrpc.c
+ * @brief RPC frame benchmarks, reported as JSON.
+ *
+ * Not run by ctest. Fills the buffer of a headless 200x60 EditorSession
+ * with highlighted C (string literals with quotes and escapes, tabs
+ * expanded, long and short lines), and reports for every path the time
+ * per frame and the throughput in MB/s of output, so results can be
+ * compared across releases:
+ *
+ *   - session_frame: editor_session_frame() after every row changed (a
+ *     scroll by a screenful), so each frame builds every row
+ *   - serialize_viewmodel: jsonrpc_serialize_viewmodel() of one frame
+ *   - serialize_viewmodel_msgpack: the same in MessagePack
+ *   - serialize_viewmodel_delta: a delta of the frame before, one row
+ *     edited
+ *
+ *   bench_jsonrpc [-n passes]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "internal.h"
+#include "session.h"
+#include "syntax.h"
+#include "jsonrpc.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define BENCH_PASSES 2000
+#define BENCH_ROWS 60
+#define BENCH_COLS 200
+#define BENCH_LINES 4000
+
+static const char *corpus[] = {
+    "static int parse_header(const char *line, size_t len, struct header *out) {",
+    "\tif (len == 0 || line[0] == '#') return 0;",
+    "\tconst char *colon = memchr(line, ':', len);",
+    "\tif (!colon) { fprintf(stderr, \"bad header: \\\"%.*s\\\"\\n\", (int)len, line); return -1; }",
+    "\tout->name = strndup(line, (size_t)(colon - line));  /* Owned by the caller */",
+    "\tout->value = strndup(colon + 1, len - (size_t)(colon - line) - 1);",
+    "\treturn out->name && out->value ? 1 : -1;",
+    "}",
+    "",
+    "/* A long line of data, wider than the screen: {\"key\": \"value\", \"list\": [1, 2, 3], \"path\": \"C:\\\\temp\"} and more text past it */",
+};
+
+#define CORPUS_COUNT (sizeof(corpus)/sizeof(corpus[0]))
+
+static void report(JsonBuilder *jb, const char *path, uint64_t ns, int passes,
+                   size_t bytes) {
+    json_object_start(jb);
+    json_kv_string(jb, "path", path);
+    json_kv_double(jb, "us_per_frame", (double)ns / 1e3 / passes);
+    json_kv_double(jb, "mb_per_s", ns ? (double)bytes * passes * 1e3 / (double)ns : 0);
+    json_kv_int(jb, "bytes", (int)bytes);
+    json_object_end(jb);
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            passes = atoi(argv[i + 1]);
+            if (passes < 1) passes = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    EditorConfig config = { .rows = BENCH_ROWS, .cols = BENCH_COLS };
+    EditorSession *session = editor_session_new(&config);
+    if (!session) {
+        perror("editor_session_new");
+        return 1;
+    }
+    editor_ctx_t *ctx = editor_session_get_ctx(session);
+    syntax_select_for_filename(ctx, "bench.c");
+    for (int r = 0; r < BENCH_LINES; r++) {
+        const char *line = corpus[r % CORPUS_COUNT];
+        editor_insert_row(ctx, ctx->model.numrows, (char *)line, strlen(line));
+    }
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "passes", passes);
+    json_kv_int(&jb, "rows", BENCH_ROWS);
+    json_kv_int(&jb, "cols", BENCH_COLS);
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+
+    /* Every row new each frame: a screenful down, then back up */
+    uint64_t start = uv_hrtime();
+    size_t bytes = 0;
+    for (int p = 0; p < passes; p++) {
+        ctx->view.rowoff = p % 2 ? 0 : BENCH_ROWS;
+        const EditorViewModel *vm = editor_session_frame(session);
+        if (!vm) {
+            perror("editor_session_frame");
+            return 1;
+        }
+        if (vm->rows_rebuilt == 0) fprintf(stderr, "warning: no rows rebuilt\n");
+    }
+    const EditorViewModel *frame = editor_session_frame(session);
+    for (int i = 0; i < frame->row_count; i++)
+        for (int j = 0; j < frame->row_views[i].segment_count; j++)
+            bytes += frame->row_views[i].segments[j].len;
+    report(&jb, "session_frame", uv_hrtime() - start, passes, bytes);
+
+    EditorViewModel *vm = editor_session_snapshot(session);
+    char *out = jsonrpc_serialize_viewmodel(vm);
+    bytes = out ? strlen(out) : 0;
+    free(out);
+    start = uv_hrtime();
+    for (int p = 0; p < passes; p++) free(jsonrpc_serialize_viewmodel(vm));
+    report(&jb, "serialize_viewmodel", uv_hrtime() - start, passes, bytes);
+
+    size_t len = 0;
+    free(jsonrpc_serialize_viewmodel_msgpack(vm, &len));
+    start = uv_hrtime();
+    for (int p = 0; p < passes; p++) free(jsonrpc_serialize_viewmodel_msgpack(vm, NULL));
+    report(&jb, "serialize_viewmodel_msgpack", uv_hrtime() - start, passes, len);
+
+    ctx->view.cy = 1;
+    editor_insert_char(ctx, 'x');
+    EditorViewModel *next = editor_session_snapshot(session);
+    out = jsonrpc_serialize_viewmodel_delta(vm, next);
+    bytes = out ? strlen(out) : 0;
+    free(out);
+    start = uv_hrtime();
+    for (int p = 0; p < passes; p++) free(jsonrpc_serialize_viewmodel_delta(vm, next));
+    report(&jb, "serialize_viewmodel_delta", uv_hrtime() - start, passes, bytes);
+
+    editor_viewmodel_free(vm);
+    editor_viewmodel_free(next);
+    editor_session_free(session);
+
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * @file bench_memory.c
+ * @brief Memory footprint benchmark: bytes per line by file shape, as JSON.
+ *
+ * Not run by ctest. Writes a file of each shape below, opens it, then
+ * highlights every row, and reports the heap held per line at each step,
+ * by subsystem (memstats.h, on for the whole run), along with the row
+ * arena's own view (chunk bytes held and bytes in use) and the process's
+ * peak RSS so far:
+ *
+ *   - short: lines of a few characters
+ *   - typical: C of 20 to 60 columns
+ *   - long: lines of 400 columns
+ *   - empty: every other line empty
+ *   - tabs: indented with tabs, so render differs from chars
+ *   - utf8: lines of wide (CJK) characters
+ *
+ *   bench_memory [-r rows]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "internal.h"
+#include "arena.h"
+#include "memstats.h"
+#include "syntax.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_ROWS 100000
+#define BENCH_FILE "/tmp/loki_bench_memory.c"
+
+enum { SHAPE_SHORT, SHAPE_TYPICAL, SHAPE_LONG, SHAPE_EMPTY, SHAPE_TABS,
+       SHAPE_UTF8, SHAPES };
+
+static const char *shape_names[SHAPES] = {
+    "short", "typical", "long", "empty", "tabs", "utf8"
+};
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+/* Line 'r' of 'shape', without its newline */
+static int shape_line(int shape, int r, char *line, size_t size) {
+    switch (shape) {
+    case SHAPE_SHORT:
+        return snprintf(line, size, "x%d;", r % 100);
+    case SHAPE_TYPICAL:
+        switch (r % 4) {
+        case 0: return snprintf(line, size, "static int step_%d(int a) {", r);
+        case 1: return snprintf(line, size, "    if (a > %d) return a * 2; // big", r);
+        case 2: return snprintf(line, size, "    return a - %d;", r % 97);
+        default: return snprintf(line, size, "}");
+        }
+    case SHAPE_LONG: {
+        int len = 0;
+        while (len < 400) len += snprintf(line + len, size - (size_t)len, "value_%d + ", r);
+        return len;
+    }
+    case SHAPE_EMPTY:
+        return r % 2 ? 0 : snprintf(line, size, "int v%d = %d;", r, r);
+    case SHAPE_TABS:
+        return snprintf(line, size, "\t\tif (a) {\tb = %d;\t}", r);
+    default: {
+        /* Twelve three-byte characters, each two columns wide */
+        int len = 0;
+        for (int i = 0; i < 12; i++) len += snprintf(line + len, size - (size_t)len, "\xe4\xb8\xad");
+        return len;
+    }
+    }
+}
+
+static void write_file(const char *path, int shape, int rows) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    char line[512];
+    for (int r = 0; r < rows; r++) {
+        int len = shape_line(shape, r, line, sizeof(line));
+        fwrite(line, 1, (size_t)len, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+/* The live bytes of every tag */
+static void snapshot(int64_t bytes[MEM_TAGS]) {
+    for (int tag = 0; tag < MEM_TAGS; tag++) {
+        MemTagStats st;
+        memstats_get((MemTag)tag, &st);
+        bytes[tag] = st.bytes;
+    }
+}
+
+/* The bytes per line gained by each tag since 'base', as an object */
+static void json_per_line(JsonBuilder *jb, const char *key, const int64_t base[MEM_TAGS],
+                          int rows) {
+    int64_t now[MEM_TAGS], total = 0;
+    snapshot(now);
+    json_key(jb, key);
+    jb->need_comma = 0;
+    json_object_start(jb);
+    for (int tag = 0; tag < MEM_TAGS; tag++) {
+        json_kv_double(jb, memstats_tag_name((MemTag)tag), (double)(now[tag] - base[tag]) / rows);
+        total += now[tag] - base[tag];
+    }
+    json_kv_double(jb, "total", (double)total / rows);
+    json_object_end(jb);
+}
+
+static void run(JsonBuilder *jb, int shape, int rows) {
+    char path[] = BENCH_FILE;
+    write_file(path, shape, rows);
+
+    int64_t base[MEM_TAGS];
+    snapshot(base);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    if (editor_open(&ctx, path) != 0) {
+        fprintf(stderr, "bench_memory: can't open %s\n", path);
+        exit(1);
+    }
+    off_t file_bytes = 0;
+    for (int r = 0; r < ctx.model.numrows; r++) file_bytes += ctx.model.row[r].size + 1;
+
+    json_object_start(jb);
+    json_kv_string(jb, "shape", shape_names[shape]);
+    json_kv_int(jb, "rows", ctx.model.numrows);
+    json_kv_double(jb, "file_bytes_per_line", (double)file_bytes / rows);
+    json_per_line(jb, "opened", base, rows);
+
+    ArenaStats as = {0};
+    if (ctx.model.arena) arena_get_stats(ctx.model.arena, &as);
+    json_kv_double(jb, "arena_held_per_line", (double)(as.chunk_bytes + as.large_bytes) / rows);
+    json_kv_double(jb, "arena_used_per_line", (double)(as.used_bytes + as.large_bytes) / rows);
+
+    for (int r = 0; r < ctx.model.numrows; r++)
+        syntax_update_row(&ctx, &ctx.model.row[r]);
+    json_per_line(jb, "highlighted", base, rows);
+    json_kv_int(jb, "peak_rss_kb", (int)peak_rss_kb());
+    json_object_end(jb);
+
+    editor_ctx_free(&ctx);
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    int rows = BENCH_ROWS;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-r") == 0) {
+            rows = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s [-r rows]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rows < 1) rows = 1;
+    memstats_enable();
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "rows", rows);
+    json_kv_int(&jb, "row_struct_bytes", (int)sizeof(t_erow));
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+    for (int s = 0; s < SHAPES; s++) run(&jb, s, rows);
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    return 0;
+}
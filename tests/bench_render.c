@@ -0,0 +1,245 @@
+/**
+ * @file bench_render.c
+ * @brief Rendering benchmark: frames drawn offscreen, reported as JSON.
+ *
+ * Not run by ctest. Draws frames of a C file through a capture renderer
+ * (renderer.h), at several screen sizes, for each scenario:
+ *
+ *   - scroll: the cursor moved down a line per frame, past the screen
+ *   - page: a screen down per frame
+ *   - edit: a character typed per frame, mid-screen
+ *   - select: a selection grown by a line per frame
+ *
+ * once as the editor draws ("diff": unchanged rows repeated, the frame
+ * diffed against the last one) and once with both forgotten before every
+ * frame ("full"), so the effect of damage tracking and diffing shows. For
+ * each it reports the bytes and escape sequences written per frame, the
+ * rows segmented per frame, and the time editor_refresh_screen() takes to
+ * build a frame (mean and p99 in microseconds, the best of the passes).
+ *
+ *   bench_render [-n passes] [-f frames]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "internal.h"
+#include "renderer.h"
+#include "syntax.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define BENCH_PASSES 3
+#define BENCH_FRAMES 400
+#define BENCH_FILE_ROWS 20000
+
+static const struct {
+    int cols, rows;
+} sizes[] = {
+    {80, 24}, {160, 50}, {300, 100}
+};
+
+enum { SCENARIO_SCROLL, SCENARIO_PAGE, SCENARIO_EDIT, SCENARIO_SELECT, SCENARIOS };
+
+static const char *scenario_names[SCENARIOS] = {
+    "scroll", "page", "edit", "select"
+};
+
+typedef struct {
+    uint64_t *ns;               /* Build time of each frame */
+    int frames;
+    size_t bytes;
+    unsigned long escapes;
+    unsigned long rows_rebuilt;
+} FrameStats;
+
+static int cmp_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double mean_us(const FrameStats *s) {
+    uint64_t sum = 0;
+    for (int i = 0; i < s->frames; i++) sum += s->ns[i];
+    return s->frames ? (double)sum / s->frames / 1e3 : 0;
+}
+
+/* Sorts the samples */
+static double p99_us(FrameStats *s) {
+    if (s->frames == 0) return 0;
+    qsort(s->ns, (size_t)s->frames, sizeof(*s->ns), cmp_ns);
+    int i = s->frames * 99 / 100;
+    if (i >= s->frames) i = s->frames - 1;
+    return (double)s->ns[i] / 1e3;
+}
+
+/* A buffer of typical C, highlighted */
+static void fill(editor_ctx_t *ctx) {
+    char line[160];
+    for (int r = 0; r < BENCH_FILE_ROWS; r++) {
+        int len;
+        switch (r % 8) {
+        case 0: len = snprintf(line, sizeof(line), "/* Block %d: compute the next value */", r); break;
+        case 1: len = snprintf(line, sizeof(line), "static int step_%d(int a, const char *s) {", r); break;
+        case 2: len = snprintf(line, sizeof(line), "    if (a > %d && s[0] != '\\0') return a * %d;", r, r % 97); break;
+        case 3: len = snprintf(line, sizeof(line), "    printf(\"value %%d of %s\\n\", a);", "the table"); break;
+        case 4: len = snprintf(line, sizeof(line), "    for (int i = 0; i < %d; i++) a += i; // sum", r % 50); break;
+        case 5: len = snprintf(line, sizeof(line), "    return a - %d;", r); break;
+        case 6: len = snprintf(line, sizeof(line), "}"); break;
+        default: len = 0; break;
+        }
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+    char name[] = "bench.c";
+    syntax_select_for_filename(ctx, name);
+    for (int r = 0; r < ctx->model.numrows; r++)
+        syntax_update_row(ctx, &ctx->model.row[r]);
+}
+
+static int cursor_row(const editor_ctx_t *ctx) {
+    return ctx->view.rowoff + ctx->view.cy;
+}
+
+/* One step of 'scenario' before a frame */
+static void step(editor_ctx_t *ctx, int scenario, int frame) {
+    switch (scenario) {
+    case SCENARIO_SCROLL:
+        editor_move_cursor(ctx, ARROW_DOWN);
+        break;
+    case SCENARIO_PAGE:
+        for (int i = 0; i < ctx->view.screenrows; i++)
+            editor_move_cursor(ctx, ARROW_DOWN);
+        break;
+    case SCENARIO_EDIT:
+        editor_insert_char(ctx, 'a' + frame % 26);
+        break;
+    case SCENARIO_SELECT:
+        editor_move_cursor(ctx, ARROW_DOWN);
+        ctx->view.sel_end_y = cursor_row(ctx);
+        ctx->view.sel_end_x = ctx->view.coloff + ctx->view.cx;
+        break;
+    }
+}
+
+static void run(int cols, int rows, int scenario, int full, int nframes,
+                FrameStats *out) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screencols = cols;
+    ctx.view.screenrows = rows - 2;     /* Status and message lines */
+    fill(&ctx);
+    Renderer *r = capture_renderer_create();
+    if (!r) {
+        perror("Out of memory");
+        exit(1);
+    }
+    editor_ctx_set_renderer(&ctx, r);
+
+    /* Start mid-screen, a selection from there */
+    for (int i = 0; i < ctx.view.screenrows / 2; i++)
+        editor_move_cursor(&ctx, ARROW_DOWN);
+    if (scenario == SCENARIO_SELECT) {
+        ctx.view.sel_active = 1;
+        ctx.view.sel_start_y = ctx.view.sel_end_y = cursor_row(&ctx);
+        ctx.view.sel_start_x = ctx.view.sel_end_x = 0;
+    }
+    editor_refresh_screen(&ctx);
+
+    memset(out, 0, sizeof(*out));
+    out->ns = malloc((size_t)nframes * sizeof(*out->ns));
+    if (!out->ns) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (int f = 0; f < nframes; f++) {
+        step(&ctx, scenario, f);
+        if (full) {
+            terminal_renderer_invalidate(r);
+            ctx.frame.valid = 0;
+        }
+        capture_renderer_clear(r);
+        uint64_t start = uv_hrtime();
+        editor_refresh_screen(&ctx);
+        out->ns[f] = uv_hrtime() - start;
+
+        TerminalRenderStats stats;
+        terminal_renderer_get_stats(r, &stats);
+        out->bytes += stats.frame_bytes;
+        out->escapes += stats.frame_escapes;
+        out->rows_rebuilt += (unsigned long)ctx.frame.rows_rebuilt;
+        out->frames++;
+    }
+    editor_ctx_free(&ctx);      /* Destroys the renderer */
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    int nframes = BENCH_FRAMES;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            passes = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            nframes = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes] [-f frames]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (passes < 1) passes = 1;
+    if (nframes < 1) nframes = 1;
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "passes", passes);
+    json_kv_int(&jb, "frames", nframes);
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        for (int s = 0; s < SCENARIOS; s++) {
+            for (int full = 0; full <= 1; full++) {
+                /* Output is the same every pass; keep the fastest */
+                FrameStats best = {0};
+                double best_mean = 0;
+                for (int p = 0; p < passes; p++) {
+                    FrameStats fs;
+                    run(sizes[z].cols, sizes[z].rows, s, full, nframes, &fs);
+                    double mean = mean_us(&fs);
+                    if (best.ns == NULL || mean < best_mean) {
+                        free(best.ns);
+                        best = fs;
+                        best_mean = mean;
+                    } else {
+                        free(fs.ns);
+                    }
+                }
+
+                json_object_start(&jb);
+                json_kv_string(&jb, "scenario", scenario_names[s]);
+                json_kv_string(&jb, "mode", full ? "full" : "diff");
+                json_kv_int(&jb, "cols", sizes[z].cols);
+                json_kv_int(&jb, "rows", sizes[z].rows);
+                json_kv_double(&jb, "bytes_per_frame", (double)best.bytes / best.frames);
+                json_kv_double(&jb, "escapes_per_frame", (double)best.escapes / best.frames);
+                json_kv_double(&jb, "rows_rebuilt_per_frame",
+                               (double)best.rows_rebuilt / best.frames);
+                json_kv_double(&jb, "build_us_mean", best_mean);
+                json_kv_double(&jb, "build_us_p99", p99_us(&best));
+                json_object_end(&jb);
+                free(best.ns);
+            }
+        }
+    }
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    return 0;
+}
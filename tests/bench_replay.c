@@ -0,0 +1,238 @@
+/**
+ * @file bench_replay.c
+ * @brief Keystroke latency benchmark: a key trace replayed headless.
+ *
+ * Not run by ctest. Opens a copy of FILE in a headless EditorSession and
+ * replays a key trace into it, recorded with `loki --record-keys TRACE`,
+ * or without one a synthetic trace (scrolling, paging, typing, deleting,
+ * a paste). For every event it times each step a frontend waits for
+ * before the key shows:
+ *
+ *   - handle_event: editor_session_handle_event()
+ *   - viewmodel: editor_session_frame() after it
+ *   - serialize: jsonrpc_serialize_viewmodel() of that frame
+ *   - total: the three together
+ *
+ * and reports their p50, p99 and max in microseconds, as JSON, so runs
+ * can be compared across releases. The trace ends early at a key that
+ * would quit: Ctrl-Q, or an ex command such as :q or :wq.
+ *
+ *   bench_replay [-n passes] FILE [TRACE]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "internal.h"
+#include "session.h"
+#include "event.h"
+#include "jsonrpc.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#define BENCH_PASSES 5
+#define BENCH_ROWS 60
+#define BENCH_COLS 200
+
+enum { STEP_HANDLE, STEP_VIEWMODEL, STEP_SERIALIZE, STEP_TOTAL, STEPS };
+
+static const char *step_names[STEPS] = {
+    "handle_event", "viewmodel", "serialize", "total"
+};
+
+typedef struct {
+    uint64_t *ns;
+    size_t count, cap;
+} Samples;
+
+static void add_sample(Samples *s, uint64_t ns) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+        if (!s->ns) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    s->ns[s->count++] = ns;
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const Samples *s, int pct) {
+    if (s->count == 0) return 0;
+    size_t i = s->count * (size_t)pct / 100;
+    if (i >= s->count) i = s->count - 1;
+    return (double)s->ns[i] / 1e3;
+}
+
+/* Write the synthetic trace to 'path' */
+static int write_synthetic_trace(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "# synthetic key trace\n");
+    for (int i = 0; i < 300; i++) fprintf(fp, "%d\n", 'j');
+    for (int i = 0; i < 100; i++) fprintf(fp, "%d\n", 'k');
+    for (int i = 0; i < 20; i++) fprintf(fp, "%d\n", PAGE_DOWN);
+    for (int i = 0; i < 10; i++) fprintf(fp, "%d\n", PAGE_UP);
+    fprintf(fp, "%d\n", 'i');
+    for (int i = 0; i < 20; i++) {
+        for (const char *p = "hello, world "; *p; p++) fprintf(fp, "%d\n", *p);
+        if (i % 4 == 3) fprintf(fp, "%d\n", ENTER);
+    }
+    for (int i = 0; i < 50; i++) fprintf(fp, "%d\n", BACKSPACE);
+    fprintf(fp, "paste 2000\n");
+    for (int i = 0; i < 2000; i++) fputc(i % 50 == 49 ? '\n' : 'a' + i % 26, fp);
+    fputc('\n', fp);
+    fprintf(fp, "%d\n", ESC);
+    for (int i = 0; i < 40; i++) fprintf(fp, "%d\n", 'x');
+    return fclose(fp);
+}
+
+/* Would 'ev' leave the editor (and the process)? */
+static int quits(EditorSession *session, const EditorEvent *ev) {
+    if (ev->type != EVENT_KEY) return 0;
+    int c = event_to_keycode(ev);
+    if (c == CTRL_Q) return 1;
+
+    editor_ctx_t *ctx = editor_session_get_ctx(session);
+    if (c != ENTER || ctx->view.mode != MODE_COMMAND) return 0;
+    const char *cmd = ctx->view.cmd_buffer;
+    while (*cmd == ':' || *cmd == ' ') cmd++;
+    size_t len = strcspn(cmd, " !");
+    static const char *quit_cmds[] = { "q", "quit", "wq", "x" };
+    for (size_t i = 0; i < sizeof(quit_cmds) / sizeof(quit_cmds[0]); i++)
+        if (len == strlen(quit_cmds[i]) && strncmp(cmd, quit_cmds[i], len) == 0) return 1;
+    return 0;
+}
+
+/* Copy 'path' to a temporary file of the same extension (for its syntax),
+ * so that the trace can save without touching it. Returns the copy's path
+ * in 'copy', or -1. */
+static int copy_file(const char *path, char *copy, size_t size) {
+    const char *dot = strrchr(path, '.');
+    const char *ext = dot && !strchr(dot, '/') ? dot : "";
+    snprintf(copy, size, "/tmp/loki-replay-XXXXXX%s", ext);
+    int out = mkstemps(copy, (int)strlen(ext));
+    FILE *in = fopen(path, "rb");
+    if (out < 0 || !in) {
+        if (in) fclose(in);
+        if (out >= 0) close(out);
+        return -1;
+    }
+    char buf[65536];
+    size_t n;
+    int ok = 1;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok = write(out, buf, n) == (ssize_t)n;
+    fclose(in);
+    close(out);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+        passes = atoi(argv[arg + 1]);
+        if (passes < 1) passes = 1;
+        arg += 2;
+    }
+    if (arg >= argc || argc - arg > 2) {
+        fprintf(stderr, "Usage: %s [-n passes] FILE [TRACE]\n", argv[0]);
+        return 1;
+    }
+    const char *file = argv[arg];
+    const char *trace = arg + 1 < argc ? argv[arg + 1] : NULL;
+
+    char synthetic[] = "/tmp/loki-replay-trace-XXXXXX";
+    if (!trace) {
+        int fd = mkstemp(synthetic);
+        if (fd < 0 || close(fd) != 0 || write_synthetic_trace(synthetic) != 0) {
+            perror(synthetic);
+            return 1;
+        }
+    }
+    char copy[4096];
+    if (copy_file(file, copy, sizeof(copy)) != 0) {
+        perror(file);
+        return 1;
+    }
+
+    Samples samples[STEPS] = {{0}};
+    int events = 0, quit = 0;
+    for (int p = 0; p < passes; p++) {
+        EventSource *src = event_source_replay(trace ? trace : synthetic);
+        if (!src) {
+            perror(trace ? trace : synthetic);
+            return 1;
+        }
+        EditorConfig config = { .rows = BENCH_ROWS, .cols = BENCH_COLS, .filename = copy };
+        EditorSession *session = editor_session_new(&config);
+        if (!session) {
+            perror("editor_session_new");
+            return 1;
+        }
+
+        events = 0;
+        while (src->poll(src)) {
+            EditorEvent ev = src->read(src, 0);
+            if ((quit = quits(session, &ev))) break;
+
+            uint64_t t0 = uv_hrtime();
+            editor_session_handle_event(session, &ev);
+            uint64_t t1 = uv_hrtime();
+            const EditorViewModel *vm = editor_session_frame(session);
+            uint64_t t2 = uv_hrtime();
+            free(jsonrpc_serialize_viewmodel(vm));
+            uint64_t t3 = uv_hrtime();
+
+            add_sample(&samples[STEP_HANDLE], t1 - t0);
+            add_sample(&samples[STEP_VIEWMODEL], t2 - t1);
+            add_sample(&samples[STEP_SERIALIZE], t3 - t2);
+            add_sample(&samples[STEP_TOTAL], t3 - t0);
+            events++;
+        }
+        editor_session_free(session);
+        src->destroy(src);
+    }
+    remove(copy);
+    if (!trace) remove(synthetic);
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_string(&jb, "file", file);
+    json_kv_string(&jb, "trace", trace ? trace : "synthetic");
+    json_kv_int(&jb, "passes", passes);
+    json_kv_int(&jb, "events", events);
+    json_kv_bool(&jb, "ended_at_quit", quit);
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+    for (int s = 0; s < STEPS; s++) {
+        qsort(samples[s].ns, samples[s].count, sizeof(uint64_t), cmp_ns);
+        json_object_start(&jb);
+        json_kv_string(&jb, "step", step_names[s]);
+        json_kv_double(&jb, "p50_us", percentile_us(&samples[s], 50));
+        json_kv_double(&jb, "p99_us", percentile_us(&samples[s], 99));
+        json_kv_double(&jb, "max_us", percentile_us(&samples[s], 100));
+        json_object_end(&jb);
+        free(samples[s].ns);
+    }
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    return 0;
+}
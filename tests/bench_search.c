@@ -0,0 +1,285 @@
+/**
+ * @file bench_search.c
+ * @brief Search benchmarks, reported as JSON.
+ *
+ * Not run by ctest. Fills the buffer of a headless EditorSession with a
+ * generated corpus at several sizes, and reports for every corpus, size
+ * and search path the time per pass, the throughput in GB/s of buffer
+ * text, and the matches found, so results can be compared across
+ * releases:
+ *
+ *   - find_next_match: editor_find_next_match() from the top, one call
+ *     per matching row, until it wraps around
+ *   - find_next_match_icase: the same with :set ignorecase
+ *   - regexp_search: every match of a regex, row by row
+ *   - substitute: :%s/needle/NEEDLE/g, then back again (two passes over
+ *     the buffer, so the corpus is unchanged)
+ *   - find_next_match_indexed: as find_next_match, once the trigram index
+ *     is built (the build is not timed)
+ *
+ * Where the hardware counters can be read (bench_counters.h), each result
+ * also has the cycles, instructions, cache misses and branch misses per
+ * byte searched; "counters" at the top says which are counted, or why
+ * none are.
+ *
+ * Corpora have short lines (log lines), long lines (4 KiB) or UTF-8 text
+ * (Cyrillic and Greek) with a Cyrillic needle, each with the needle in
+ * every row (high density) or about once per 256 KiB (low density).
+ *
+ *   bench_search [-n passes] [-s MiB[,MiB...]]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "internal.h"
+#include "session.h"
+#include "search_index.h"
+#include "regexp.h"
+#include "undo.h"
+#include "json.h"
+#include "bench_counters.h"
+#include "command/command_impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define BENCH_PASSES 3
+#define BENCH_MAX_SIZES 8
+#define BENCH_LONG_LINE 4096
+#define BENCH_LOW_DENSITY (256 * 1024)
+
+enum { CORPUS_SHORT, CORPUS_LONG, CORPUS_UNICODE };
+
+static const struct {
+    const char *name;
+    int kind;
+    const char *needle;         /* What the rows with a match contain */
+    const char *upper;          /* ... in upper case, for :s */
+    const char *regex;          /* Matches the needle and its number */
+} corpora[] = {
+    { "short_lines", CORPUS_SHORT,   "needle", "NEEDLE", "ne+dle [0-9]+" },
+    { "long_lines",  CORPUS_LONG,    "needle", "NEEDLE", "ne+dle [0-9]+" },
+    { "unicode",     CORPUS_UNICODE, "игла",   "ИГЛА",   "иг[^ ]*а [0-9]+" },
+};
+
+#define CORPUS_COUNT (sizeof(corpora)/sizeof(corpora[0]))
+
+static const char *unicode_words[] = {
+    "ошибка", "сервер", "запрос", "λάθος", "δίκτυο", "αίτημα", "ответ",
+    "Ζήτημα", "Сетевой", "διακομιστής",
+};
+
+/* One line of the corpus, without the needle */
+static int corpus_line(char *line, size_t size, int kind, int n) {
+    if (kind == CORPUS_UNICODE) {
+        const char *a = unicode_words[n % 10], *b = unicode_words[(n / 10) % 10];
+        return snprintf(line, size, "%d %s: %s %d готово", n, a, b, n % 1000);
+    }
+    return snprintf(line, size, "2026-10-14 12:%02d:%02d INFO worker %d: "
+                    "request %d ok", (n / 60) % 60, n % 60, n % 16, n);
+}
+
+/* Rows of about 'bytes' bytes in total; 'every'-th row has the needle */
+static void fill_corpus(editor_ctx_t *ctx, int kind, const char *needle,
+                        size_t bytes, int dense) {
+    char *line = malloc(BENCH_LONG_LINE + 256);
+    if (!line) {
+        perror("Out of memory");
+        exit(1);
+    }
+    int line_len = kind == CORPUS_LONG ? BENCH_LONG_LINE : 48;
+    int every = dense ? 1 : BENCH_LOW_DENSITY / line_len;
+    size_t total = 0;
+    for (int r = 0; total < bytes; r++) {
+        int len = corpus_line(line, 256, kind, r);
+        /* Long lines: segments up to the length, the needle last */
+        while (kind == CORPUS_LONG && len < BENCH_LONG_LINE - 128)
+            len += corpus_line(line + len, 256, kind, r + len);
+        if (r % every == every / 2)
+            len += snprintf(line + len, 64, " %s %d", needle, r % 1000);
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+        total += (size_t)len + 1;
+    }
+    free(line);
+}
+
+static size_t buffer_bytes(const editor_ctx_t *ctx) {
+    size_t bytes = 0;
+    for (int r = 0; r < ctx->model.numrows; r++)
+        bytes += (size_t)ctx->model.row[r].size + 1;
+    return bytes;
+}
+
+/* The wall time and hardware counts of a timed section */
+typedef struct Timing {
+    uint64_t start;
+    uint64_t ns;
+    BenchCounts counts;
+} Timing;
+
+static void timing_start(Timing *t) {
+    memset(t, 0, sizeof(*t));
+    bench_counters_start();
+    t->start = uv_hrtime();
+}
+
+static void timing_stop(Timing *t) {
+    t->ns = uv_hrtime() - t->start;
+    bench_counters_stop(&t->counts);
+}
+
+static void report(JsonBuilder *jb, const char *corpus, const char *density,
+                   size_t bytes, const char *path, const Timing *t, int passes,
+                   int matches) {
+    json_object_start(jb);
+    json_kv_string(jb, "corpus", corpus);
+    json_kv_string(jb, "density", density);
+    json_kv_int(jb, "bytes", (int)bytes);
+    json_kv_string(jb, "path", path);
+    json_kv_double(jb, "ms_per_pass", (double)t->ns / 1e6 / passes);
+    json_kv_double(jb, "gb_per_s",
+                   t->ns ? (double)bytes * passes / (double)t->ns : 0);
+    json_kv_int(jb, "matches", matches);
+    bench_counters_json(jb, &t->counts, (double)bytes * passes, "byte");
+    json_object_end(jb);
+}
+
+/* Rows with a match, walking down from the top until the search wraps */
+static int walk_matches(editor_ctx_t *ctx, const char *needle) {
+    int n = 0, off, row = -1;
+    for (;;) {
+        int next = editor_find_next_match(ctx, needle, row, 1, &off);
+        if (next <= row) break;
+        row = next;
+        n++;
+    }
+    return n;
+}
+
+static int regex_matches(editor_ctx_t *ctx, Regexp *re) {
+    int n = 0;
+    for (int r = 0; r < ctx->model.numrows; r++) {
+        const t_erow *row = &ctx->model.row[r];
+        int i = 0, start, end;
+        while (i <= row->size &&
+               regexp_search(re, row->chars, row->size, i, &start, &end)) {
+            n++;
+            i = end > start ? end : end + 1;
+        }
+    }
+    return n;
+}
+
+static void bench_buffer(JsonBuilder *jb, editor_ctx_t *ctx, int c,
+                         const char *density, int passes) {
+    const char *name = corpora[c].name, *needle = corpora[c].needle;
+    size_t bytes = buffer_bytes(ctx);
+    int matches = 0;
+    Timing t;
+
+    timing_start(&t);
+    for (int p = 0; p < passes; p++) matches = walk_matches(ctx, needle);
+    timing_stop(&t);
+    report(jb, name, density, bytes, "find_next_match", &t, passes, matches);
+
+    ctx->view.ignore_case = 1;
+    timing_start(&t);
+    for (int p = 0; p < passes; p++) matches = walk_matches(ctx, needle);
+    timing_stop(&t);
+    report(jb, name, density, bytes, "find_next_match_icase",
+           &t, passes, matches);
+    ctx->view.ignore_case = 0;
+
+    const char *error;
+    Regexp *re = regexp_compile(corpora[c].regex, 0, &error);
+    if (re) {
+        timing_start(&t);
+        for (int p = 0; p < passes; p++) matches = regex_matches(ctx, re);
+        timing_stop(&t);
+        report(jb, name, density, bytes, "regexp_search", &t, passes, matches);
+        regexp_free(re);
+    }
+
+    char there[64], back[64];
+    snprintf(there, sizeof(there), "s/%s/%s/g", needle, corpora[c].upper);
+    snprintf(back, sizeof(back), "s/%s/%s/g", corpora[c].upper, needle);
+    timing_start(&t);
+    for (int p = 0; p < passes; p++) {
+        cmd_substitute_range(ctx, 0, ctx->model.numrows - 1, there);
+        cmd_substitute_range(ctx, 0, ctx->model.numrows - 1, back);
+    }
+    timing_stop(&t);
+    report(jb, name, density, bytes * 2, "substitute",
+           &t, passes, walk_matches(ctx, needle));
+    undo_clear(ctx);
+
+    search_index_enable(&ctx->model);
+    search_index_wait(&ctx->model);
+    timing_start(&t);
+    for (int p = 0; p < passes; p++) matches = walk_matches(ctx, needle);
+    timing_stop(&t);
+    report(jb, name, density, bytes, "find_next_match_indexed",
+           &t, passes, matches);
+    search_index_disable(&ctx->model);
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    int sizes[BENCH_MAX_SIZES] = {1, 16, 64}, nsizes = 3;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            passes = atoi(argv[i + 1]);
+            if (passes < 1) passes = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            nsizes = 0;
+            for (char *s = argv[i + 1]; *s && nsizes < BENCH_MAX_SIZES; ) {
+                int mib = (int)strtol(s, &s, 10);
+                if (mib > 0) sizes[nsizes++] = mib;
+                if (*s) s++;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes] [-s MiB[,MiB...]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_counters_open();
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "passes", passes);
+    json_kv_string(&jb, "counters", bench_counters_status());
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+
+    for (int s = 0; s < nsizes; s++) {
+        for (unsigned int c = 0; c < CORPUS_COUNT; c++) {
+            for (int dense = 1; dense >= 0; dense--) {
+                EditorConfig config = { .rows = 24, .cols = 80 };
+                EditorSession *session = editor_session_new(&config);
+                if (!session) {
+                    perror("editor_session_new");
+                    return 1;
+                }
+                editor_ctx_t *ctx = editor_session_get_ctx(session);
+                fill_corpus(ctx, corpora[c].kind, corpora[c].needle,
+                            (size_t)sizes[s] << 20, dense);
+                bench_buffer(&jb, ctx, (int)c, dense ? "high" : "low", passes);
+                editor_session_free(session);
+            }
+        }
+    }
+
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    bench_counters_close();
+    return 0;
+}
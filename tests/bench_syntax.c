@@ -0,0 +1,416 @@
+/**
+ * @file bench_syntax.c
+ * @brief Syntax highlighting benchmarks, reported as JSON.
+ *
+ * Not run by ctest. Highlights a corpus and reports, for every corpus and
+ * highlighting path, the time per byte and the row buffer allocations per
+ * row, so results can be compared across releases:
+ *
+ *   - syntax_update_row: the built-in rules (C, Python, Lua, Scheme,
+ *     Markdown, and a C file made of one very long line)
+ *   - syntax_update_row_rules: the same rules run by the generic
+ *     highlighter, for the languages that have a generated one
+ *   - treesitter_update_row: the tree-sitter query, for the grammars the
+ *     build includes
+ *   - lua_hook: syntax_fresh_rows() with the Lua highlight hook, first with
+ *     an empty result cache, then with every row cached
+ *
+ * Where the hardware counters can be read (bench_counters.h), each result
+ * also has the cycles, instructions, cache misses and branch misses per
+ * row; "counters" at the top says which are counted, or why none are.
+ *
+ * Without arguments the corpus is generated; with file arguments each file
+ * is highlighted with the language its name selects instead. Bytes are
+ * rendered bytes, so the long line counts its highlighting window only.
+ *
+ *   bench_syntax [-n passes] [file...]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "internal.h"
+#include "syntax.h"
+#include "languages.h"
+#include "json.h"
+#include "bench_counters.h"
+#include "loki/lua.h"
+#include "treesitter.h"
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define BENCH_ROWS 4000
+#define BENCH_PASSES 20
+#define BENCH_LONG_LINE (4 * 1024 * 1024)
+
+/* A line of typical code: a keyword, identifiers, a call with a string and
+ * a number, and a trailing comment. */
+static int sample_code_line(char *line, size_t size, char **keywords,
+                            const char *scs, int n) {
+    const char *kw = "if";
+    int nkw = 0;
+    while (keywords && keywords[nkw]) nkw++;
+    if (nkw) kw = keywords[n % nkw];
+    int kwlen = (int)strlen(kw);
+    if (kwlen && kw[kwlen-1] == '|') kwlen--;
+    if (!scs[0]) scs = "#";
+
+    return snprintf(line, size,
+                    "    %.*s result_value_%d = compute_something(\"text %d\", "
+                    "%d.5, other_identifier); %s trailing comment",
+                    kwlen, kw, n, n, n % 1000, scs);
+}
+
+static void add_row(editor_ctx_t *ctx, const char *s, int len) {
+    editor_insert_row(ctx, ctx->model.numrows, (char *)s, (size_t)len);
+}
+
+/* 'fmt' (taking n, n and n % 1000) gives lines the grammar parses; without
+ * it lines are made of the syntax's keywords, which tree-sitter would spend
+ * its time recovering from. */
+static void fill_code(editor_ctx_t *ctx, const char *fmt, char **keywords,
+                      const char *scs) {
+    char line[256];
+    for (int r = 0; r < BENCH_ROWS; r++) {
+        int len = fmt ? snprintf(line, sizeof(line), fmt, r, r, r % 1000) :
+                  sample_code_line(line, sizeof(line), keywords, scs, r);
+        add_row(ctx, line, len);
+    }
+}
+
+/* Prose with headings, lists, inline code and fenced Python blocks */
+static void fill_markdown(editor_ctx_t *ctx) {
+    char line[256];
+    for (int r = 0; r < BENCH_ROWS; r++) {
+        int len, k = r % 20;
+        if (k == 0)
+            len = snprintf(line, sizeof(line), "## Section %d", r / 20);
+        else if (k == 5 || k == 12)
+            len = snprintf(line, sizeof(line), "%s", k == 5 ? "```python" : "```");
+        else if (k > 5 && k < 12)
+            len = sample_code_line(line, sizeof(line), NULL, "#", r);
+        else if (k % 3 == 0)
+            len = snprintf(line, sizeof(line), "* item %d with `inline code` and **bold** text", r);
+        else
+            len = snprintf(line, sizeof(line),
+                           "Some prose on row %d, with a [link](http://example.com) "
+                           "and *emphasis* to scan past.", r);
+        add_row(ctx, line, len);
+    }
+}
+
+static void fill_long_line(editor_ctx_t *ctx) {
+    char *buf = malloc(BENCH_LONG_LINE);
+    if (!buf) {
+        perror("Out of memory");
+        exit(1);
+    }
+    char line[256];
+    int len = 0;
+    while (1) {
+        int n = sample_code_line(line, sizeof(line), NULL, "", len);
+        n -= (int)strlen(" # trailing comment");
+        if (len + n > BENCH_LONG_LINE) break;
+        memcpy(buf + len, line, (size_t)n);
+        len += n;
+    }
+    add_row(ctx, buf, len);
+    free(buf);
+}
+
+static int load_file(editor_ctx_t *ctx, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+        add_row(ctx, line, (int)len);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+static struct t_editor_syntax *builtin_syntax(const char *ext) {
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        char **fm = HLDB[j].filematch;
+        for (int i = 0; fm && fm[i]; i++)
+            if (strcmp(fm[i], ext) == 0) return &HLDB[j];
+    }
+    return NULL;
+}
+
+typedef struct BenchTotals {
+    uint64_t ns;
+    size_t bytes;
+    size_t rows;
+    unsigned long allocs;
+    BenchCounts counts;
+} BenchTotals;
+
+static unsigned long row_allocs(const editor_ctx_t *ctx) {
+    const EditorAllocStats *s = &ctx->model.alloc_stats;
+    return s->chars + s->render + s->hl;
+}
+
+static size_t rendered_bytes(const editor_ctx_t *ctx) {
+    size_t bytes = 0;
+    for (int r = 0; r < ctx->model.numrows; r++)
+        bytes += (size_t)ctx->model.row[r].rsize;
+    return bytes;
+}
+
+static void report(JsonBuilder *jb, const char *corpus, const char *path,
+                   const BenchTotals *t) {
+    json_object_start(jb);
+    json_kv_string(jb, "corpus", corpus);
+    json_kv_string(jb, "path", path);
+    json_kv_int(jb, "bytes", (int)t->bytes);
+    json_kv_int(jb, "rows", (int)t->rows);
+    json_kv_double(jb, "ns_per_byte",
+                   t->bytes ? (double)t->ns / (double)t->bytes : 0);
+    json_kv_double(jb, "mb_per_s",
+                   t->ns ? (double)t->bytes * 1e3 / (double)t->ns : 0);
+    json_kv_double(jb, "allocs_per_row",
+                   t->rows ? (double)t->allocs / (double)t->rows : 0);
+    bench_counters_json(jb, &t->counts, (double)t->rows, "row");
+    json_object_end(jb);
+}
+
+static void report_skipped(JsonBuilder *jb, const char *corpus,
+                           const char *path, const char *why) {
+    json_object_start(jb);
+    json_kv_string(jb, "corpus", corpus);
+    json_kv_string(jb, "path", path);
+    json_kv_string(jb, "skipped", why);
+    json_object_end(jb);
+}
+
+static void bench_update_row(JsonBuilder *jb, editor_ctx_t *ctx,
+                             const char *corpus, const char *path, int passes) {
+    BenchTotals t = {0};
+    unsigned long allocs = row_allocs(ctx);
+    bench_counters_start();
+    uint64_t start = uv_hrtime();
+    for (int p = 0; p < passes; p++) {
+        for (int r = 0; r < ctx->model.numrows; r++)
+            syntax_update_row(ctx, &ctx->model.row[r]);
+    }
+    t.ns = uv_hrtime() - start;
+    bench_counters_stop(&t.counts);
+    t.bytes = rendered_bytes(ctx) * (size_t)passes;
+    t.rows = (size_t)ctx->model.numrows * (size_t)passes;
+    t.allocs = row_allocs(ctx) - allocs;
+    report(jb, corpus, path, &t);
+}
+
+/* A built-in language's rules run by the generic highlighter instead of
+ * the one generated from them */
+static void bench_rules(JsonBuilder *jb, editor_ctx_t *ctx,
+                        const char *corpus, int passes) {
+    struct t_editor_syntax *syntax = ctx->view.syntax;
+    if (!syntax || syntax->type != HL_TYPE_GENERATED) return;
+    struct t_editor_syntax rules = *syntax;
+    rules.type = HL_TYPE_C;
+    rules.scan = NULL;
+    rules.kwtable = NULL;
+    if (syntax_compile_keywords(&rules) != 0) return;
+    ctx->view.syntax = &rules;
+    bench_update_row(jb, ctx, corpus, "syntax_update_row_rules", passes);
+    ctx->view.syntax = syntax;
+    syntax_free_keywords(&rules);
+}
+
+#ifdef LOKI_USE_LINENOISE
+static void bench_treesitter(JsonBuilder *jb, editor_ctx_t *ctx,
+                             const char *corpus, const char *lang, int passes) {
+    ctx->model.ts_state = treesitter_init(lang);
+    if (!ctx->model.ts_state) {
+        report_skipped(jb, corpus, "treesitter_update_row", "treesitter_init() failed");
+        return;
+    }
+    /* Parse the tree and size every hl buffer first */
+    syntax_fresh_rows(ctx, 0, ctx->model.numrows);
+
+    BenchTotals t = {0};
+    unsigned long allocs = row_allocs(ctx);
+    bench_counters_start();
+    uint64_t start = uv_hrtime();
+    for (int p = 0; p < passes; p++) {
+        for (int r = 0; r < ctx->model.numrows; r++)
+            treesitter_update_row(ctx, &ctx->model.row[r], ctx->model.ts_state);
+    }
+    t.ns = uv_hrtime() - start;
+    bench_counters_stop(&t.counts);
+    t.bytes = rendered_bytes(ctx) * (size_t)passes;
+    t.rows = (size_t)ctx->model.numrows * (size_t)passes;
+    t.allocs = row_allocs(ctx) - allocs;
+    report(jb, corpus, "treesitter_update_row", &t);
+
+    treesitter_free(ctx->model.ts_state);
+    ctx->model.ts_state = NULL;
+}
+#endif
+
+static const char lua_hook_source[] =
+    "function loki.highlight_row(idx, text, render)\n"
+    "    local s = render:find('result', 1, true)\n"
+    "    if s then\n"
+    "        return { spans = { { start = s, length = 6, style = 'keyword2' } } }\n"
+    "    end\n"
+    "end\n";
+
+/* syntax_fresh_rows() over every row with the Lua hook installed */
+static void bench_lua_pass(JsonBuilder *jb, editor_ctx_t *ctx,
+                           const char *corpus, const char *path, int cold,
+                           int passes) {
+    BenchTotals t = {0};
+    unsigned long allocs = row_allocs(ctx);
+    for (int p = 0; p < passes; p++) {
+        if (cold) lua_highlight_cache_free(ctx->lua_host);
+        for (int r = 0; r < ctx->model.numrows; r++)
+            syntax_invalidate_row(ctx, &ctx->model.row[r]);
+        bench_counters_start();
+        uint64_t start = uv_hrtime();
+        syntax_fresh_rows(ctx, 0, ctx->model.numrows);
+        t.ns += uv_hrtime() - start;
+        bench_counters_stop(&t.counts);
+    }
+    t.bytes = rendered_bytes(ctx) * (size_t)passes;
+    t.rows = (size_t)ctx->model.numrows * (size_t)passes;
+    t.allocs = row_allocs(ctx) - allocs;
+    report(jb, corpus, path, &t);
+}
+
+static void bench_lua_hook(JsonBuilder *jb, editor_ctx_t *ctx,
+                           const char *corpus, int passes) {
+    LuaHost *host = lua_host_create();
+    if (host) {
+        ctx->lua_host = host;
+        host->L = loki_lua_bootstrap(ctx, NULL);
+    }
+    if (!host || !host->L || luaL_dostring(host->L, lua_hook_source) != 0) {
+        report_skipped(jb, corpus, "lua_hook", "Lua unavailable");
+    } else {
+        syntax_set_row_hook(lua_highlight_rows);
+        bench_lua_pass(jb, ctx, corpus, "lua_hook", 1, passes);
+        bench_lua_pass(jb, ctx, corpus, "lua_hook_cached", 0, passes);
+        syntax_set_row_hook(NULL);
+    }
+    lua_host_free(host);
+    ctx->lua_host = NULL;
+}
+
+enum { CORPUS_CODE, CORPUS_MARKDOWN, CORPUS_LONG_LINE };
+
+static const struct {
+    const char *name;
+    const char *ext;            /* Built-in syntax */
+    int kind;
+    const char *ts_lang;        /* Tree-sitter grammar, or NULL */
+    const char *line;           /* fill_code() format, or NULL */
+} corpora[] = {
+    { "c",         ".c",   CORPUS_CODE,      NULL,       NULL },
+    { "python",    ".py",  CORPUS_CODE,      "python",
+      "if result_value_%d == compute_something(\"text %d\", %d.5, "
+      "other_identifier): pass  # trailing comment" },
+    { "lua",       ".lua", CORPUS_CODE,      "lua",
+      "local result_value_%d = compute_something(\"text %d\", %d.5, "
+      "other_identifier) or nil -- trailing comment" },
+    { "scheme",    ".scm", CORPUS_CODE,      "scheme",
+      "(define result-value-%d (compute-something \"text %d\" %d.5 "
+      "other-identifier)) ; trailing comment" },
+    { "markdown",  ".md",  CORPUS_MARKDOWN,  "markdown", NULL },
+    { "long_line", ".c",   CORPUS_LONG_LINE, NULL,       NULL },
+};
+
+#define CORPUS_COUNT (sizeof(corpora)/sizeof(corpora[0]))
+
+static void bench_corpus(JsonBuilder *jb, editor_ctx_t *ctx, const char *name,
+                         const char *ts_lang, int passes) {
+    bench_update_row(jb, ctx, name, "syntax_update_row", passes);
+    bench_rules(jb, ctx, name, passes);
+#ifdef LOKI_USE_LINENOISE
+    if (ts_lang) bench_treesitter(jb, ctx, name, ts_lang, passes);
+#else
+    (void)ts_lang;
+#endif
+    bench_lua_hook(jb, ctx, name, passes);
+}
+
+int main(int argc, char **argv) {
+    int passes = BENCH_PASSES;
+    int argi = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        passes = atoi(argv[2]);
+        if (passes < 1) passes = 1;
+        argi = 3;
+    }
+
+    bench_counters_open();
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "passes", passes);
+    json_kv_string(&jb, "counters", bench_counters_status());
+    json_key(&jb, "results");
+    jb.need_comma = 0;
+    json_array_start(&jb);
+
+    if (argi < argc) {
+        for (; argi < argc; argi++) {
+            editor_ctx_t ctx;
+            editor_ctx_init(&ctx);
+            if (load_file(&ctx, argv[argi]) == 0) {
+                syntax_select_for_filename(&ctx, argv[argi]);
+                if (ctx.view.syntax)
+                    bench_corpus(&jb, &ctx, argv[argi], NULL, passes);
+                else
+                    report_skipped(&jb, argv[argi], "syntax_update_row",
+                                   "no syntax for this name");
+            }
+            editor_ctx_free(&ctx);
+        }
+    } else {
+        for (unsigned int c = 0; c < CORPUS_COUNT; c++) {
+            struct t_editor_syntax *s = builtin_syntax(corpora[c].ext);
+            if (!s || syntax_compile_keywords(s) != 0) {
+                report_skipped(&jb, corpora[c].name, "syntax_update_row",
+                               "no built-in syntax");
+                continue;
+            }
+
+            editor_ctx_t ctx;
+            editor_ctx_init(&ctx);
+            if (corpora[c].kind == CORPUS_MARKDOWN) fill_markdown(&ctx);
+            else if (corpora[c].kind == CORPUS_LONG_LINE) fill_long_line(&ctx);
+            else fill_code(&ctx, corpora[c].line, s->keywords,
+                           s->singleline_comment_start);
+            ctx.view.syntax = s;
+            bench_corpus(&jb, &ctx, corpora[c].name, corpora[c].ts_lang, passes);
+            editor_ctx_free(&ctx);
+        }
+        /* Csound highlighting is not part of core loki */
+        report_skipped(&jb, "csound", "syntax_update_row",
+                       "editor_update_syntax_csound() is a stub");
+    }
+
+    json_array_end(&jb);
+    json_object_end(&jb);
+    if (jb.error) {
+        perror("Out of memory");
+        return 1;
+    }
+    printf("%s\n", json_builder_get(&jb));
+    json_builder_free(&jb);
+    bench_counters_close();
+    return 0;
+}
@@ -0,0 +1,127 @@
+/* test_ai_context.c - Unit tests for AI request context
+ *
+ * Tests for:
+ * - Rows escaped as one JSON string, after a prefix
+ * - Windows around the cursor, and ranges clamped to the buffer
+ * - Rows escaped once: a build after an edit escapes only the rows
+ *   changed, and rows moved by an insert above cost nothing
+ * - Large contexts, and the cache dropping rows no longer used
+ */
+
+#include "test_framework.h"
+#include "ai_context.h"
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+
+static void fill(editor_ctx_t *ctx, const char **lines, int n) {
+    editor_ctx_init(ctx);
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+TEST(ai_context_escapes_rows) {
+    const char *lines[] = { "say \"hi\"", "\ttab\\slash", "", "ctl\x01" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 4);
+    AiContext *ac = ai_context_new();
+    AiContextRange all = { 0, 3 };
+    size_t len;
+    const char *json = ai_context_build(ac, &ctx.model, &all, 1, "Q:\n", &len);
+    ASSERT_STR_EQ(json, "\"Q:\\nsay \\\"hi\\\"\\n\\ttab\\\\slash\\n\\nctl\\u0001\"");
+    ASSERT_EQ(len, strlen(json));
+
+    /* Ranges apart by a blank line, clamped, empty ones left out */
+    AiContextRange two[] = { { 3, 9 }, { 5, 6 }, { -2, 0 } };
+    json = ai_context_build(ac, &ctx.model, two, 3, NULL, &len);
+    ASSERT_STR_EQ(json, "\"ctl\\u0001\\n\\nsay \\\"hi\\\"\"");
+    json = ai_context_build(ac, &ctx.model, two + 1, 1, NULL, &len);
+    ASSERT_STR_EQ(json, "\"\"");
+    ai_context_free(ac);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ai_context_window_around_cursor) {
+    const char *lines[] = { "a", "b", "c", "d", "e" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 5);
+    ctx.view.rowoff = 1;
+    ctx.view.cy = 1;
+    AiContextRange r = ai_context_window(&ctx, 1, 5);
+    ASSERT_EQ(r.first, 1);
+    ASSERT_EQ(r.last, 4);
+    r = ai_context_window(&ctx, 9, 0);
+    ASSERT_EQ(r.first, 0);
+    ASSERT_EQ(r.last, 2);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ai_context_escapes_changed_rows_only) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[64];
+    for (int i = 0; i < 100; i++) {
+        int len = snprintf(line, sizeof(line), "row \"%d\"", i);
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+    AiContext *ac = ai_context_new();
+    AiContextRange all = { 0, 99 };
+    size_t len1, len2;
+    ai_context_build(ac, &ctx.model, &all, 1, NULL, &len1);
+    AiContextStats st;
+    ai_context_get_stats(ac, &st);
+    ASSERT_EQ(st.escaped, 100);
+    ASSERT_EQ(st.entries, 100);
+
+    /* One row changed, one inserted above the rest */
+    editor_row_set(&ctx, &ctx.model.row[50], "xrow \"50\"", 9);
+    editor_insert_row(&ctx, 0, "new", 3);
+    all.last = 100;
+    const char *json = ai_context_build(ac, &ctx.model, &all, 1, NULL, &len2);
+    ai_context_get_stats(ac, &st);
+    ASSERT_EQ(st.escaped, 102);
+    ASSERT_EQ(st.rows, 201);
+    ASSERT_EQ(len2, len1 + 1 + 5);
+    ASSERT_EQ(strncmp(json, "\"new\\nrow \\\"0\\\"\\n", 17), 0);
+    ASSERT_TRUE(strstr(json, "49\\\"\\nxrow \\\"50\\\"\\nrow") != NULL);
+    ai_context_free(ac);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ai_context_large_and_swept) {
+    int n = 10000;
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[64];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "\tline %d of the buffer", i);
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+    AiContext *ac = ai_context_new();
+    AiContextRange all = { 0, n - 1 };
+    size_t len;
+    const char *json = ai_context_build(ac, &ctx.model, &all, 1, NULL, &len);
+    ASSERT_EQ(strncmp(json, "\"\\tline 0 of", 12), 0);
+    ASSERT_STR_EQ(json + len - 24, "line 9999 of the buffer\"");
+    json = ai_context_build(ac, &ctx.model, &all, 1, NULL, &len);
+    AiContextStats st;
+    ai_context_get_stats(ac, &st);
+    ASSERT_EQ(st.escaped, (uint64_t)n);
+    ASSERT_EQ(st.entries, n);
+
+    /* A small window: the rest of the cache goes */
+    AiContextRange few = { 0, 9 };
+    ai_context_build(ac, &ctx.model, &few, 1, NULL, &len);
+    ai_context_get_stats(ac, &st);
+    ASSERT_EQ(st.entries, 10);
+    ASSERT_EQ(st.escaped, (uint64_t)n);
+    ai_context_free(ac);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("AI context")
+    RUN_TEST(ai_context_escapes_rows);
+    RUN_TEST(ai_context_window_around_cursor);
+    RUN_TEST(ai_context_escapes_changed_rows_only);
+    RUN_TEST(ai_context_large_and_swept);
+END_TEST_SUITE()
@@ -0,0 +1,176 @@
+/* test_arena.c - Unit tests for the row storage slab allocator
+ *
+ * Tests for:
+ * - Size-class rounding and free-list reuse
+ * - Dedicated large blocks
+ * - Memory statistics
+ * - Row buffers allocated from a model's arena
+ * - Shared row contents outliving the rows and arena they came from
+ */
+
+#include "test_framework.h"
+#include "arena.h"
+#include "loki/core.h"
+#include "internal.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Row editing functions from core.c (declared locally, as in undo.c) */
+void editor_row_append_string(editor_ctx_t *ctx, t_erow *row, char *s, size_t len);
+void editor_del_row(editor_ctx_t *ctx, int at);
+
+TEST(alloc_rounds_up_to_size_class) {
+    RowArena *arena = arena_create();
+    ASSERT_NOT_NULL(arena);
+
+    int cap = 0;
+    char *p = arena_alloc(arena, 17, &cap);
+    ASSERT_NOT_NULL(p);
+    ASSERT_EQ(cap, 32);
+    memset(p, 'x', cap);
+
+    ASSERT_NOT_NULL(arena_alloc(arena, 0, &cap));
+    ASSERT_EQ(cap, 16);
+
+    arena_destroy(arena);
+}
+
+TEST(freed_blocks_are_reused) {
+    RowArena *arena = arena_create();
+    int cap;
+
+    char *a = arena_alloc(arena, 100, &cap);
+    arena_free(arena, a, cap);
+    char *b = arena_alloc(arena, 120, &cap);
+    ASSERT_TRUE(a == b);
+
+    ArenaStats st;
+    arena_get_stats(arena, &st);
+    ASSERT_EQ((int)st.chunks, 1);
+    ASSERT_EQ((int)st.used_bytes, 128);
+    ASSERT_EQ((int)st.free_bytes, 0);
+
+    arena_destroy(arena);
+}
+
+TEST(large_blocks_are_tracked) {
+    RowArena *arena = arena_create();
+    int cap;
+
+    char *p = arena_alloc(arena, ARENA_MAX_CLASS + 1, &cap);
+    ASSERT_NOT_NULL(p);
+    ASSERT_EQ(cap, ARENA_MAX_CLASS + 1);
+    memset(p, 'y', cap);
+
+    ArenaStats st;
+    arena_get_stats(arena, &st);
+    ASSERT_EQ((int)st.large_blocks, 1);
+    ASSERT_EQ((int)st.large_bytes, ARENA_MAX_CLASS + 1);
+
+    arena_free(arena, p, cap);
+    arena_get_stats(arena, &st);
+    ASSERT_EQ((int)st.large_blocks, 0);
+
+    /* Left allocated on purpose: destroy releases it. */
+    arena_alloc(arena, 3 * ARENA_MAX_CLASS, &cap);
+    arena_destroy(arena);
+}
+
+TEST(many_small_blocks_span_chunks) {
+    RowArena *arena = arena_create();
+    int cap;
+
+    for (int i = 0; i < 10000; i++) {
+        char *p = arena_alloc(arena, 24, &cap);
+        ASSERT_NOT_NULL(p);
+        memset(p, 'z', cap);
+    }
+
+    ArenaStats st;
+    arena_get_stats(arena, &st);
+    ASSERT_TRUE(st.chunks > 1);
+    ASSERT_EQ((int)st.used_bytes, 10000 * 32);
+
+    arena_destroy(arena);
+}
+
+#ifndef LOKI_NO_ROW_ARENA
+TEST(editor_rows_live_in_model_arena) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_model_use_arena(&ctx.model);
+
+    for (int i = 0; i < 100; i++)
+        editor_insert_row(&ctx, i, "hello\tworld", 11);
+    editor_del_row(&ctx, 50);
+
+    ASSERT_NOT_NULL(ctx.model.arena);
+    ASSERT_EQ(ctx.model.row[0].arena_bufs & ROW_BUF_CHARS, ROW_BUF_CHARS);
+    ASSERT_EQ(ctx.model.row[0].arena_bufs & ROW_BUF_RENDER, ROW_BUF_RENDER);
+    ASSERT_STR_EQ(ctx.model.row[99 - 1].chars, "hello\tworld");
+
+    ArenaStats st;
+    arena_get_stats(ctx.model.arena, &st);
+    ASSERT_TRUE(st.free_bytes > 0);  /* The deleted row's blocks */
+
+    editor_ctx_free(&ctx);
+    ASSERT_NULL(ctx.model.arena);
+    ASSERT_NULL(ctx.model.row);
+}
+
+TEST(heap_rows_migrate_into_arena_on_growth) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_model_use_arena(&ctx.model);
+
+    /* Rows built by hand own plain heap blocks of unknown size. */
+    ctx.model.numrows = 1;
+    ctx.model.row = calloc(1, sizeof(t_erow));
+    ctx.model.row[0].chars = strdup("abc");
+    ctx.model.row[0].size = 3;
+
+    editor_row_append_string(&ctx, &ctx.model.row[0], "def", 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abcdef");
+    ASSERT_TRUE(ctx.model.row[0].chars_cap >= 7);
+
+    editor_row_append_string(&ctx, &ctx.model.row[0], "ghijklmnop", 10);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abcdefghijklmnop");
+    ASSERT_TRUE(ctx.model.row[0].arena_bufs & ROW_BUF_CHARS);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(shared_rows_keep_their_arena_alive) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_model_use_arena(&ctx.model);
+    editor_insert_row(&ctx, 0, "hello", 5);
+
+    RowShare *share = editor_row_share(&ctx.model, &ctx.model.row[0]);
+    ASSERT_EQ(share->refs, 2);
+    ASSERT_NOT_NULL(share->arena);
+    ASSERT_EQ(ctx.model.row[0].arena_bufs & ROW_BUF_CHARS, 0);
+
+    /* The model lets go of its rows and its arena; the share holds on */
+    editor_model_free_rows(&ctx.model);
+    ASSERT_NULL(ctx.model.arena);
+    ASSERT_EQ(share->refs, 1);
+    ASSERT_EQ(memcmp(share->chars, "hello", 5), 0);
+    editor_row_share_release(share);
+
+    editor_ctx_free(&ctx);
+}
+
+#endif /* LOKI_NO_ROW_ARENA */
+
+BEGIN_TEST_SUITE("Row Arena")
+    RUN_TEST(alloc_rounds_up_to_size_class);
+    RUN_TEST(freed_blocks_are_reused);
+    RUN_TEST(large_blocks_are_tracked);
+    RUN_TEST(many_small_blocks_span_chunks);
+#ifndef LOKI_NO_ROW_ARENA
+    RUN_TEST(editor_rows_live_in_model_arena);
+    RUN_TEST(heap_rows_migrate_into_arena_on_growth);
+    RUN_TEST(shared_rows_keep_their_arena_alive);
+#endif
+END_TEST_SUITE()
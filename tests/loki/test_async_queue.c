@@ -1,12 +1,19 @@
 /* test_async_queue.c - Unit tests for async event queue
  *
- * Tests queue operations, thread safety, and event handling.
+ * Tests queue operations, thread safety, and event handling, overflow
+ * policies and counters, batches, coalescing keys, sliced dispatch,
+ * priority lanes, pooled payloads and dispatch timings.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "test_framework.h"
 #include "async_queue.h"
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
 
 /* Test: Queue initialization */
 TEST(queue_init) {
@@ -170,12 +177,12 @@ TEST(queue_full) {
 
     AsyncEventQueue *queue = async_queue_global();
 
-    /* Fill the queue */
-    for (int i = 0; i < ASYNC_QUEUE_SIZE - 1; i++) {
+    /* Fill the queue: every slot holds an event */
+    for (int i = 0; i < ASYNC_QUEUE_SIZE; i++) {
         ASSERT_EQ(async_queue_push_timer(queue, i, NULL), 0);
     }
 
-    ASSERT_EQ(async_queue_count(queue), ASYNC_QUEUE_SIZE - 1);
+    ASSERT_EQ(async_queue_count(queue), ASYNC_QUEUE_SIZE);
 
     /* Queue should be full - next push should fail */
     ASSERT_EQ(async_queue_push_timer(queue, 999, NULL), -1);
@@ -186,7 +193,20 @@ TEST(queue_full) {
     while (async_queue_poll(queue, &event) == 0) {
         count++;
     }
-    ASSERT_EQ(count, ASYNC_QUEUE_SIZE - 1);
+    ASSERT_EQ(count, ASYNC_QUEUE_SIZE);
+
+    /* Slots freed by the consumer take events again, lap after lap */
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < ASYNC_QUEUE_SIZE; i++) {
+            ASSERT_EQ(async_queue_push_timer(queue, i, NULL), 0);
+        }
+        ASSERT_EQ(async_queue_push_timer(queue, 999, NULL), -1);
+        for (int i = 0; i < ASYNC_QUEUE_SIZE / 2; i++) {
+            ASSERT_EQ(async_queue_poll(queue, &event), 0);
+            ASSERT_EQ(event.data.timer.timer_id, i);
+        }
+        while (async_queue_poll(queue, &event) == 0) {}
+    }
 
     async_queue_cleanup();
 }
@@ -380,6 +400,533 @@ TEST(queue_concurrent_push) {
     async_queue_cleanup();
 }
 
+static AsyncEvent user_event(int type, int64_t value) {
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = ASYNC_EVENT_USER + type;
+    ev.data.user.i64[0] = value;
+    return ev;
+}
+
+/* Test: Capacity is set at init, rounded up to a power of 2 */
+TEST(queue_sized) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(5), 0);
+    ASSERT_EQ(async_queue_init_sized(8), 0);     /* Same size: no-op */
+    ASSERT_EQ(async_queue_init_sized(64), -1);
+
+    AsyncEvent ev = user_event(0, 1);
+    for (int i = 0; i < 8; i++) ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+    ASSERT_EQ(async_queue_push(NULL, &ev), -1);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ(st.capacity, 8);
+    ASSERT_EQ(st.high_water, 8);
+    ASSERT_EQ((int)st.pushed, 8);
+    ASSERT_EQ((int)st.rejected, 1);
+
+    async_queue_cleanup();
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ(st.capacity, 0);
+}
+
+/* Test: A dropping type loses its overflow and counts it */
+TEST(queue_policy_drop) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    async_queue_set_policy(NULL, ASYNC_EVENT_USER, ASYNC_POLICY_DROP);
+
+    AsyncEvent ev = user_event(0, 1);
+    for (int i = 0; i < 4; i++) ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+    ASSERT_EQ(async_queue_push(NULL, &ev), 1);
+    ASSERT_EQ(async_queue_push(NULL, &ev), 1);
+    /* Other types keep the default */
+    AsyncEvent other = user_event(1, 2);
+    ASSERT_EQ(async_queue_push(NULL, &other), -1);
+
+    /* Heap data of a dropped custom event is freed */
+    async_queue_set_policy(NULL, ASYNC_EVENT_CUSTOM, ASYNC_POLICY_DROP);
+    ASSERT_EQ(async_queue_push_custom(NULL, "tag", "data", 4), 1);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ((int)st.dropped, 3);
+    ASSERT_EQ((int)st.rejected, 1);
+    ASSERT_EQ(async_queue_count(NULL), 4);
+
+    async_queue_cleanup();
+}
+
+/* Test: A coalescing type keeps its newest overflow, after the rest */
+TEST(queue_policy_coalesce) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    async_queue_set_policy(NULL, ASYNC_EVENT_CUSTOM, ASYNC_POLICY_COALESCE);
+
+    AsyncEvent ev = user_event(0, 0);
+    for (int i = 0; i < 4; i++) {
+        ev.data.user.i64[0] = i;
+        ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+    }
+    for (int i = 0; i < 3; i++) {
+        char text[8];
+        int n = snprintf(text, sizeof(text), "p%d", i);
+        ASSERT_EQ(async_queue_push_custom(NULL, "progress", text, (size_t)n + 1), 0);
+    }
+    ASSERT_EQ(async_queue_count(NULL), 5);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ((int)st.coalesced, 2);
+
+    /* Once one is held, newer ones replace it even with room in the ring */
+    AsyncEvent event;
+    ASSERT_EQ(async_queue_poll(NULL, &event), 0);
+    ASSERT_EQ(event.data.user.i64[0], 0);
+    ASSERT_EQ(async_queue_push_custom(NULL, "progress", "p3", 3), 0);
+
+    for (int i = 1; i < 4; i++) {
+        ASSERT_EQ(async_queue_poll(NULL, &event), 0);
+        ASSERT_EQ(event.type, ASYNC_EVENT_USER);
+        ASSERT_EQ(event.data.user.i64[0], i);
+    }
+    ASSERT_EQ(async_queue_peek(NULL, &event), 0);
+    ASSERT_EQ(event.type, ASYNC_EVENT_CUSTOM);
+    ASSERT_FALSE(async_queue_is_empty(NULL));
+    ASSERT_EQ(async_queue_poll(NULL, &event), 0);
+    ASSERT_STR_EQ((const char *)event.data.custom.data, "p3");
+    async_event_cleanup(&event);
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+    ASSERT_EQ(async_queue_count(NULL), 0);
+
+    /* With nothing held, they go through the ring again */
+    ASSERT_EQ(async_queue_push_custom(NULL, "progress", "p4", 3), 0);
+    ASSERT_EQ(async_queue_push_custom(NULL, "progress", "p5", 3), 0);
+    ASSERT_EQ(async_queue_count(NULL), 2);
+
+    async_queue_cleanup();  /* Frees the custom data still queued */
+}
+
+#define BLOCK_EVENTS 1000
+
+static void *thread_block_func(void *arg) {
+    (void)arg;
+    for (int i = 0; i < BLOCK_EVENTS; i++) {
+        AsyncEvent ev = user_event(2, i);
+        if (async_queue_push(NULL, &ev) != 0) return (void *)1;
+    }
+    return NULL;
+}
+
+/* Test: A blocking type waits for room: none lost, memory bounded */
+TEST(queue_policy_block) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(8), 0);
+    async_queue_set_policy(NULL, ASYNC_EVENT_USER + 2, ASYNC_POLICY_BLOCK);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_block_func, NULL);
+
+    /* Drain slowly enough that the producer has to wait */
+    AsyncEvent event;
+    int64_t next = 0;
+    int out_of_order = 0;
+    while (next < BLOCK_EVENTS) {
+        if (async_queue_poll(NULL, &event) != 0) {
+            struct timespec ts = {0, 100000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        if (event.data.user.i64[0] != next++) out_of_order++;
+    }
+    void *failed;
+    pthread_join(thread, &failed);
+    ASSERT_NULL(failed);
+    ASSERT_EQ(out_of_order, 0);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_TRUE(st.blocked > 0);
+    ASSERT_TRUE(st.high_water <= 8);
+    ASSERT_EQ((int)st.pushed, BLOCK_EVENTS);
+
+    /* The consumer's own pushes fail rather than wait for themselves */
+    AsyncEvent ev = user_event(2, 0);
+    for (int i = 0; i < 8; i++) ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+    ASSERT_EQ(async_queue_push(NULL, &ev), -1);
+
+    async_queue_cleanup();
+}
+
+/* Test: A batch queues what fits at once, then follows the policies */
+TEST(queue_push_batch) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(8), 0);
+
+    AsyncEvent batch[12];
+    for (int i = 0; i < 12; i++) batch[i] = user_event(0, i);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 5), 5);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch + 5, 7), 3);  /* Full */
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 0), 0);
+    ASSERT_EQ(async_queue_push_batch(NULL, NULL, 1), -1);
+
+    AsyncEvent event;
+    for (int i = 0; i < 8; i++) {
+        ASSERT_EQ(async_queue_poll(NULL, &event), 0);
+        ASSERT_EQ(event.data.user.i64[0], i);
+        ASSERT_TRUE(event.timestamp > 0);
+    }
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    /* Wraps around the ring; a dropping type's overflow is taken */
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 6), 6);
+    async_queue_set_policy(NULL, ASYNC_EVENT_USER, ASYNC_POLICY_DROP);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch + 6, 6), 6);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ((int)st.pushed, 16);
+    ASSERT_EQ((int)st.dropped, 4);
+    ASSERT_EQ(st.high_water, 8);
+
+    async_queue_cleanup();
+}
+
+static int dispatched[8];
+static int dispatched_n;
+
+static void record_handler(AsyncEvent *event, void *ctx) {
+    (void)ctx;
+    if (dispatched_n < 8) dispatched[dispatched_n] = (int)event->data.user.i64[0];
+    dispatched_n++;
+}
+
+/* Test: Keyed events collapse to the latest of their key */
+TEST(queue_coalesce_key) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler(NULL, ASYNC_EVENT_USER, record_handler);
+    dispatched_n = 0;
+
+    /* Progress of requests 1 and 2, and an unkeyed event */
+    AsyncEvent batch[6];
+    int64_t values[6] = { 10, 20, 11, 99, 12, 21 };
+    uint64_t keys[6] = { 1, 2, 1, 0, 1, 2 };
+    for (int i = 0; i < 6; i++) {
+        batch[i] = user_event(0, values[i]);
+        batch[i].coalesce_key = keys[i];
+    }
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 6), 6);
+
+    /* A keyed event of another type is not collapsed with these */
+    AsyncEvent other = user_event(1, 0);
+    other.coalesce_key = 1;
+    ASSERT_EQ(async_queue_push(NULL, &other), 0);
+
+    ASSERT_EQ(async_queue_dispatch_all(NULL, NULL), 7);
+    ASSERT_EQ(dispatched_n, 3);
+    ASSERT_EQ(dispatched[0], 99);
+    ASSERT_EQ(dispatched[1], 12);
+    ASSERT_EQ(dispatched[2], 21);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ((int)st.coalesced, 3);
+
+    async_queue_cleanup();
+}
+
+static void slow_handler(AsyncEvent *event, void *ctx) {
+    (void)event;
+    (void)ctx;
+    struct timespec ts = {0, 20000};
+    nanosleep(&ts, NULL);
+    dispatched_n++;
+}
+
+/* Test: Dispatch stops at the slice that uses up its budget */
+TEST(queue_dispatch_budget) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler(NULL, ASYNC_EVENT_USER, slow_handler);
+    dispatched_n = 0;
+
+    AsyncEvent batch[200];
+    for (int i = 0; i < 200; i++) batch[i] = user_event(0, i);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 200), 200);
+
+    /* One slice takes over a millisecond */
+    ASSERT_EQ(async_queue_dispatch(NULL, NULL, 1000000), ASYNC_DISPATCH_SLICE);
+    ASSERT_EQ(dispatched_n, ASYNC_DISPATCH_SLICE);
+    ASSERT_FALSE(async_queue_is_empty(NULL));
+
+    /* No budget: the rest */
+    ASSERT_EQ(async_queue_dispatch(NULL, NULL, 0), 200 - ASYNC_DISPATCH_SLICE);
+    ASSERT_EQ(dispatched_n, 200);
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    async_queue_cleanup();
+}
+
+/* Contention benchmark: producers push as fast as they can while the
+ * consumer drains, as HTTP workers, language backends and timers do */
+#define BENCH_PRODUCERS 4
+#define BENCH_EVENTS 200000
+
+/* Test: Events come out of the highest lane first, each lane in order */
+TEST(queue_lane_order) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER, record_handler, ASYNC_LANE_LOW);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER + 1, record_handler, ASYNC_LANE_HIGH);
+    async_queue_set_handler(NULL, ASYNC_EVENT_USER + 2, record_handler);
+    dispatched_n = 0;
+
+    AsyncEvent batch[6];
+    int types[6] = { 0, 2, 1, 0, 1, 2 };
+    for (int i = 0; i < 6; i++) batch[i] = user_event(types[i], i);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 6), 6);
+    ASSERT_EQ(async_queue_count(NULL), 6);
+    ASSERT_FALSE(async_queue_lane_is_empty(NULL, ASYNC_LANE_LOW));
+
+    AsyncEvent ev;
+    ASSERT_EQ(async_queue_peek(NULL, &ev), 0);
+    ASSERT_EQ(ev.data.user.i64[0], 2);
+
+    ASSERT_EQ(async_queue_dispatch_all(NULL, NULL), 6);
+    int want[6] = { 2, 4, 1, 5, 0, 3 };
+    for (int i = 0; i < 6; i++) ASSERT_EQ(dispatched[i], want[i]);
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    async_queue_cleanup();
+}
+
+/* Test: A busy high lane delays the low lane by a budget, no more */
+TEST(queue_lane_no_starvation) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER, slow_handler, ASYNC_LANE_HIGH);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER + 1, slow_handler, ASYNC_LANE_LOW);
+    dispatched_n = 0;
+
+    AsyncEvent batch[200];
+    for (int i = 0; i < 200; i++) batch[i] = user_event(0, i);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 200), 200);
+    AsyncEvent low = user_event(1, 0);
+    ASSERT_EQ(async_queue_push(NULL, &low), 0);
+
+    /* The high lane's slice spends the budget; the low lane gets one */
+    ASSERT_EQ(async_queue_dispatch(NULL, NULL, 1000000), ASYNC_DISPATCH_SLICE + 1);
+    ASSERT_TRUE(async_queue_lane_is_empty(NULL, ASYNC_LANE_LOW));
+    ASSERT_FALSE(async_queue_lane_is_empty(NULL, ASYNC_LANE_HIGH));
+
+    ASSERT_EQ(async_queue_dispatch(NULL, NULL, 0), 200 - ASYNC_DISPATCH_SLICE);
+    ASSERT_EQ(dispatched_n, 201);
+
+    async_queue_cleanup();
+}
+
+/* Test: Dispatching down to a lane gives the ones below it a share */
+TEST(queue_dispatch_lanes) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER, record_handler, ASYNC_LANE_HIGH);
+    async_queue_set_handler_lane(NULL, ASYNC_EVENT_USER + 1, record_handler, ASYNC_LANE_LOW);
+    dispatched_n = 0;
+
+    AsyncEvent ev;
+    for (int i = 0; i < ASYNC_LANE_SHARE + 2; i++) {
+        ev = user_event(1, 7);
+        ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+    }
+    ev = user_event(0, 3);
+    ASSERT_EQ(async_queue_push(NULL, &ev), 0);
+
+    ASSERT_EQ(async_queue_dispatch_lanes(NULL, NULL, 0, ASYNC_LANE_HIGH),
+              1 + ASYNC_LANE_SHARE);
+    ASSERT_EQ(dispatched[0], 3);
+    ASSERT_EQ(dispatched[1], 7);
+    ASSERT_TRUE(async_queue_lane_is_empty(NULL, ASYNC_LANE_HIGH));
+    ASSERT_FALSE(async_queue_lane_is_empty(NULL, ASYNC_LANE_LOW));
+
+    ASSERT_EQ(async_queue_dispatch_lanes(NULL, NULL, 0, ASYNC_LANE_LOW), 2);
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    async_queue_cleanup();
+}
+
+/* Test: Released payloads are reused by their size class */
+TEST(payload_pool_reuse) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+
+    char *a = async_payload_alloc(100);
+    ASSERT_NOT_NULL(a);
+    memset(a, 'x', 256);                /* The whole class is usable */
+    async_payload_release(a);
+    char *b = async_payload_alloc(200);
+    ASSERT_TRUE(a == b);
+    char *big = async_payload_alloc(100000);
+    ASSERT_NOT_NULL(big);
+    memset(big, 'y', 100000);
+    async_payload_release(big);
+    async_payload_release(b);
+
+    AsyncQueueStats st;
+    async_queue_get_stats(NULL, &st);
+    ASSERT_EQ((int)st.payloads_reused, 1);
+
+    async_queue_cleanup();
+}
+
+static void *g_kept;
+
+static void keep_handler(AsyncEvent *event, void *ctx) {
+    (void)ctx;
+    g_kept = event->data.custom.data;
+    async_payload_retain(g_kept);
+}
+
+/* Test: A pushed payload is handed over, not copied, and outlives
+ * dispatch while a handler holds a reference */
+TEST(payload_push_owned) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler(NULL, ASYNC_EVENT_CUSTOM, keep_handler);
+
+    char *data = async_payload_alloc(6);
+    memcpy(data, "chunk", 6);
+    ASSERT_EQ(async_queue_push_payload(NULL, "http", data, 6), 0);
+
+    AsyncEvent ev;
+    ASSERT_EQ(async_queue_peek(NULL, &ev), 0);
+    ASSERT_TRUE(ev.data.custom.data == data);
+    ASSERT_EQ((int)ev.data.custom.len, 6);
+
+    g_kept = NULL;
+    ASSERT_EQ(async_queue_dispatch_all(NULL, NULL), 1);
+    ASSERT_TRUE(g_kept == data);
+    ASSERT_STR_EQ((char *)g_kept, "chunk");
+
+    /* The last reference gives it back to the pool */
+    async_payload_release(g_kept);
+    ASSERT_TRUE(async_payload_alloc(6) == data);
+    async_payload_release(data);
+
+    async_queue_cleanup();
+}
+
+/* Test: Dispatch records latency and handler time per type */
+TEST(queue_dispatch_timings) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler(NULL, ASYNC_EVENT_USER, slow_handler);
+    dispatched_n = 0;
+
+    AsyncHistStats latency, handler, depth;
+    ASSERT_EQ(async_queue_get_type_stats(NULL, ASYNC_EVENT_USER, &latency, &handler), -1);
+
+    AsyncEvent batch[20];
+    for (int i = 0; i < 20; i++) batch[i] = user_event(0, i);
+    ASSERT_EQ(async_queue_push_batch(NULL, batch, 20), 20);
+    AsyncEvent other = user_event(1, 0);             /* No handler */
+    ASSERT_EQ(async_queue_push(NULL, &other), 0);
+    ASSERT_EQ(async_queue_dispatch_all(NULL, NULL), 21);
+
+    ASSERT_EQ(async_queue_get_type_stats(NULL, ASYNC_EVENT_USER, &latency, &handler), 0);
+    ASSERT_EQ((int)latency.count, 20);
+    ASSERT_EQ((int)handler.count, 20);
+    /* Each handler sleeps 20us; the later events waited for the earlier */
+    ASSERT_TRUE(handler.p50 >= 17500);
+    ASSERT_TRUE(handler.p50 <= handler.p99 && handler.p99 <= handler.max);
+    ASSERT_TRUE(handler.mean >= 20000);
+    ASSERT_TRUE(latency.max >= 19 * 20000);
+    ASSERT_TRUE(latency.p50 <= latency.max);
+
+    ASSERT_EQ(async_queue_get_type_stats(NULL, ASYNC_EVENT_USER + 1, &latency, &handler), 0);
+    ASSERT_EQ((int)latency.count, 1);
+    ASSERT_EQ((int)handler.count, 0);
+
+    async_queue_get_depth_stats(NULL, &depth);
+    ASSERT_EQ((int)depth.count, 1);
+    ASSERT_TRUE(depth.max == 21);
+
+    async_queue_reset_timing(NULL);
+    ASSERT_EQ(async_queue_get_type_stats(NULL, ASYNC_EVENT_USER, NULL, NULL), -1);
+
+    async_event_set_type_name(ASYNC_EVENT_USER + 1, "probe");
+    ASSERT_STR_EQ(async_event_type_name(ASYNC_EVENT_USER + 1), "probe");
+    async_event_set_type_name(ASYNC_EVENT_USER + 1, NULL);
+    ASSERT_STR_EQ(async_event_type_name(ASYNC_EVENT_USER + 1), "USER");
+
+    async_queue_cleanup();
+}
+
+static void *thread_bench_func(void *arg) {
+    int thread_id = *(int *)arg;
+    AsyncEvent ev[8];
+    memset(ev, 0, sizeof(ev));
+    for (int j = 0; j < 8; j++) {
+        ev[j].type = ASYNC_EVENT_USER;
+        ev[j].data.user.i64[0] = thread_id;
+        ev[j].timestamp = 1;   /* Leave uv_hrtime() out of the measurement */
+    }
+
+    /* Even producers push one event at a time, odd ones batches of 8 */
+    int batch = thread_id % 2 ? 8 : 1;
+    for (int i = 0; i < BENCH_EVENTS; i += batch) {
+        for (int j = 0; j < batch; j++) ev[j].data.user.i64[1] = i + j;
+        int done = 0;
+        while ((done += async_queue_push_batch(NULL, ev + done, batch - done)) < batch)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Test: Every event arrives once, in order per producer, under contention */
+TEST(queue_contention_benchmark) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+
+    pthread_t threads[BENCH_PRODUCERS];
+    int thread_ids[BENCH_PRODUCERS];
+    int64_t next[BENCH_PRODUCERS] = {0};
+    long received = 0, out_of_order = 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < BENCH_PRODUCERS; i++) {
+        thread_ids[i] = i;
+        pthread_create(&threads[i], NULL, thread_bench_func, &thread_ids[i]);
+    }
+
+    AsyncEvent event;
+    while (received < (long)BENCH_PRODUCERS * BENCH_EVENTS) {
+        if (async_queue_poll(NULL, &event) != 0) {
+            sched_yield();
+            continue;
+        }
+        int64_t p = event.data.user.i64[0];
+        if (p < 0 || p >= BENCH_PRODUCERS || event.data.user.i64[1] != next[p]++)
+            out_of_order++;
+        received++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int i = 0; i < BENCH_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_EQ(out_of_order, 0);
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("    %d producers: %ld events in %.3fs (%.1f M events/s)\n",
+           BENCH_PRODUCERS, received, secs, received / secs / 1e6);
+
+    async_queue_cleanup();
+}
+
 /* Test suite */
 BEGIN_TEST_SUITE("Async Event Queue")
     RUN_TEST(queue_init);
@@ -397,4 +944,18 @@ BEGIN_TEST_SUITE("Async Event Queue")
     RUN_TEST(event_timestamp);
     RUN_TEST(queue_user_event);
     RUN_TEST(queue_concurrent_push);
+    RUN_TEST(queue_sized);
+    RUN_TEST(queue_policy_drop);
+    RUN_TEST(queue_policy_coalesce);
+    RUN_TEST(queue_policy_block);
+    RUN_TEST(queue_push_batch);
+    RUN_TEST(queue_coalesce_key);
+    RUN_TEST(queue_dispatch_budget);
+    RUN_TEST(queue_lane_order);
+    RUN_TEST(queue_lane_no_starvation);
+    RUN_TEST(queue_dispatch_lanes);
+    RUN_TEST(payload_pool_reuse);
+    RUN_TEST(payload_push_owned);
+    RUN_TEST(queue_dispatch_timings);
+    RUN_TEST(queue_contention_benchmark);
 END_TEST_SUITE()
@@ -0,0 +1,295 @@
+/* test_autocmd.c - Unit tests for autocommands
+ *
+ * Tests for:
+ * - Event names, and each kind of compiled glob against file names
+ * - Handlers run for their events and patterns only, in order
+ * - Handlers removed and added while an event runs them
+ * - BufRead and FileType on opening a file, BufWrite on saving it
+ * - InsertLeave on leaving INSERT mode, CursorHold by the timer service
+ */
+
+#include "test_framework.h"
+#include "autocmd.h"
+#include "async_queue.h"
+#include "timer_wheel.h"
+#include "modal.h"
+#include "event.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct Seen {
+    int calls;
+    AutocmdEvent event;
+    char match[256];
+    int del;                    /* Removed by the call, if > 0 */
+    int add;                    /* Added by the call, if set */
+} Seen;
+
+static Seen *added;             /* What a handler added by a call sees */
+
+static void seen_fn(editor_ctx_t *ctx, AutocmdEvent event, const char *match,
+                    void *opaque) {
+    Seen *seen = opaque;
+    (void)ctx;
+    seen->calls++;
+    seen->event = event;
+    snprintf(seen->match, sizeof(seen->match), "%s", match);
+    if (seen->del > 0) autocmd_del(seen->del);
+    if (seen->add) {
+        seen->add = 0;
+        autocmd_add(1u << event, "*", seen_fn, NULL, added);
+    }
+}
+
+static int released = 0;
+
+static void release(void *opaque) {
+    (void)opaque;
+    released++;
+}
+
+static void init_ctx(editor_ctx_t *ctx, const char *filename) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    if (filename) ctx->model.filename = strdup(filename);
+}
+
+TEST(autocmd_event_names) {
+    ASSERT_EQ(autocmd_event_by_name("BufRead"), AUTOCMD_BUF_READ);
+    ASSERT_EQ(autocmd_event_by_name("cursorhold"), AUTOCMD_CURSOR_HOLD);
+    ASSERT_EQ(autocmd_event_by_name("FileType"), AUTOCMD_FILE_TYPE);
+    ASSERT_EQ(autocmd_event_by_name("BufEnter"), -1);
+    ASSERT_STR_EQ(autocmd_event_name(AUTOCMD_INSERT_LEAVE), "InsertLeave");
+}
+
+TEST(autocmd_pattern_kinds) {
+    ASSERT_TRUE(autocmd_match("*", "any/thing"));
+    ASSERT_TRUE(autocmd_match(NULL, "x"));
+    ASSERT_TRUE(autocmd_match("*.c", "src/main.c"));
+    ASSERT_FALSE(autocmd_match("*.c", "src/main.h"));
+    ASSERT_FALSE(autocmd_match("*.c", "c"));
+    ASSERT_TRUE(autocmd_match("test_*", "tests/test_core.c"));
+    ASSERT_FALSE(autocmd_match("test_*", "test/core.c"));
+    ASSERT_TRUE(autocmd_match("Makefile", "/src/Makefile"));
+    ASSERT_FALSE(autocmd_match("Makefile", "Makefile.am"));
+    ASSERT_TRUE(autocmd_match("*.[ch]", "a.h"));
+    ASSERT_FALSE(autocmd_match("*.[ch]", "a.o"));
+    ASSERT_TRUE(autocmd_match("src/*.c", "src/a.c"));
+    ASSERT_FALSE(autocmd_match("src/*.c", "src/b/a.c"));
+    ASSERT_TRUE(autocmd_match("*.c,*.h", "x.h"));
+    ASSERT_TRUE(autocmd_match("*.c,,*.h", "x.c"));
+
+    /* An unnamed buffer matches "*" only */
+    ASSERT_TRUE(autocmd_match("*", ""));
+    ASSERT_FALSE(autocmd_match("*.c", ""));
+}
+
+TEST(autocmd_fire_by_event_and_pattern) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, "dir/main.c");
+    Seen c = {0}, h = {0}, any = {0};
+    ASSERT_FALSE(autocmd_has(AUTOCMD_BUF_READ));
+    autocmd_fire(&ctx, AUTOCMD_BUF_READ);
+
+    int idc = autocmd_add(1u << AUTOCMD_BUF_READ, "*.c", seen_fn, NULL, &c);
+    int idh = autocmd_add(1u << AUTOCMD_BUF_READ, "*.h", seen_fn, NULL, &h);
+    int ida = autocmd_add((1u << AUTOCMD_BUF_READ) | (1u << AUTOCMD_BUF_WRITE),
+                          NULL, seen_fn, NULL, &any);
+    ASSERT_TRUE(idc > 0 && idh > idc && ida > idh);
+    ASSERT_EQ(autocmd_add(0, "*", seen_fn, NULL, &any), -1);
+    ASSERT_TRUE(autocmd_has(AUTOCMD_BUF_READ));
+    ASSERT_FALSE(autocmd_has(AUTOCMD_INSERT_LEAVE));
+
+    autocmd_fire(&ctx, AUTOCMD_BUF_READ);
+    ASSERT_EQ(c.calls, 1);
+    ASSERT_STR_EQ(c.match, "dir/main.c");
+    ASSERT_EQ(h.calls, 0);
+    ASSERT_EQ(any.calls, 1);
+
+    autocmd_fire(&ctx, AUTOCMD_BUF_WRITE);
+    ASSERT_EQ(c.calls, 1);
+    ASSERT_EQ(any.calls, 2);
+    ASSERT_EQ(any.event, AUTOCMD_BUF_WRITE);
+
+    /* Gone from both its events */
+    ASSERT_EQ(autocmd_del(ida), 0);
+    ASSERT_EQ(autocmd_del(ida), -1);
+    ASSERT_FALSE(autocmd_has(AUTOCMD_BUF_WRITE));
+    autocmd_fire(&ctx, AUTOCMD_BUF_READ);
+    ASSERT_EQ(any.calls, 2);
+    ASSERT_EQ(c.calls, 2);
+
+    autocmd_clear();
+    ASSERT_FALSE(autocmd_has(AUTOCMD_BUF_READ));
+    editor_ctx_free(&ctx);
+}
+
+TEST(autocmd_changes_while_firing) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, "a.txt");
+    Seen first = {0}, second = {0}, third = {0}, late = {0};
+    released = 0;
+    unsigned ev = 1u << AUTOCMD_BUF_WRITE;
+    autocmd_add(ev, "*", seen_fn, release, &first);
+    int id2 = autocmd_add(ev, "*", seen_fn, release, &second);
+    autocmd_add(ev, "*", seen_fn, release, &third);
+
+    /* The first removes the second, which is not run, and adds one that
+     * is, after the third */
+    first.del = id2;
+    first.add = 1;
+    added = &late;
+    autocmd_fire(&ctx, AUTOCMD_BUF_WRITE);
+    ASSERT_EQ(first.calls, 1);
+    ASSERT_EQ(second.calls, 0);
+    ASSERT_EQ(third.calls, 1);
+    ASSERT_EQ(late.calls, 1);
+    ASSERT_EQ(released, 1);
+
+    first.del = 0;
+    autocmd_fire(&ctx, AUTOCMD_BUF_WRITE);
+    ASSERT_EQ(first.calls, 2);
+    ASSERT_EQ(second.calls, 0);
+    ASSERT_EQ(late.calls, 2);
+
+    autocmd_clear();
+    ASSERT_EQ(released, 3);
+    editor_ctx_free(&ctx);
+}
+
+TEST(autocmd_read_write_and_filetype) {
+    char dir[] = "/tmp/loki_autocmd_XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/notes.ZZQ", dir);
+    FILE *fp = fopen(path, "w");
+    ASSERT_TRUE(fp != NULL);
+    fputs("one\ntwo\n", fp);
+    fclose(fp);
+
+    Seen read = {0}, type = {0}, other = {0}, write = {0};
+    autocmd_add(1u << AUTOCMD_BUF_READ, "*.ZZQ", seen_fn, NULL, &read);
+    autocmd_add(1u << AUTOCMD_FILE_TYPE, "zzq", seen_fn, NULL, &type);
+    autocmd_add(1u << AUTOCMD_FILE_TYPE, "c", seen_fn, NULL, &other);
+    autocmd_add(1u << AUTOCMD_BUF_WRITE, "notes.*", seen_fn, NULL, &write);
+
+    editor_ctx_t ctx;
+    init_ctx(&ctx, NULL);
+    ASSERT_EQ(editor_open(&ctx, path), 0);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_EQ(read.calls, 1);
+    ASSERT_STR_EQ(read.match, path);
+    ASSERT_EQ(type.calls, 1);
+    ASSERT_STR_EQ(type.match, "zzq");
+    ASSERT_EQ(other.calls, 0);
+
+    ASSERT_EQ(editor_save(&ctx), 0);
+    ASSERT_EQ(write.calls, 1);
+
+    /* A file that is not there is not read */
+    char missing[300];
+    snprintf(missing, sizeof(missing), "%s/none.ZZQ", dir);
+    editor_ctx_t other_ctx;
+    init_ctx(&other_ctx, NULL);
+    ASSERT_EQ(editor_open(&other_ctx, missing), -1);
+    ASSERT_EQ(read.calls, 1);
+
+    autocmd_clear();
+    editor_ctx_free(&other_ctx);
+    editor_ctx_free(&ctx);
+    unlink(path);
+    rmdir(dir);
+}
+
+TEST(autocmd_insert_leave) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, "x.c");
+    editor_insert_row(&ctx, 0, "", 0);
+    Seen leave = {0};
+    autocmd_add(1u << AUTOCMD_INSERT_LEAVE, "*.c", seen_fn, NULL, &leave);
+
+    EditorEvent key = event_key('i', MOD_NONE);
+    modal_process_event(&ctx, &key);
+    ASSERT_EQ(ctx.view.mode, MODE_INSERT);
+    key = event_key('a', MOD_NONE);
+    modal_process_event(&ctx, &key);
+    ASSERT_EQ(leave.calls, 0);
+    key = event_key(ESC, MOD_NONE);
+    modal_process_event(&ctx, &key);
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_EQ(leave.calls, 1);
+    modal_process_event(&ctx, &key);
+    ASSERT_EQ(leave.calls, 1);
+
+    autocmd_clear();
+    editor_ctx_free(&ctx);
+}
+
+static editor_ctx_t *hold_ctx;
+static int other_timers = 0;
+
+static void timer_handler(AsyncEvent *event, void *data) {
+    (void)data;
+    if (!autocmd_timer_fired(event->data.timer.userdata, hold_ctx)) other_timers++;
+}
+
+TEST(autocmd_cursor_hold_by_timer) {
+    timer_service_cleanup();
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    async_queue_set_handler(NULL, ASYNC_EVENT_TIMER, timer_handler);
+    editor_ctx_t ctx;
+    init_ctx(&ctx, "x.c");
+    hold_ctx = &ctx;
+
+    /* No handler: no timer */
+    autocmd_note_input();
+    ASSERT_EQ(timer_service_timeout(), -1);
+
+    autocmd_set_hold_ms(2);
+    Seen hold = {0};
+    int id = autocmd_add(1u << AUTOCMD_CURSOR_HOLD, NULL, seen_fn, NULL, &hold);
+    ASSERT_TRUE(timer_service_timeout() >= 0);
+    struct timespec ts = {0, 5000000};
+    nanosleep(&ts, NULL);
+    timer_service_run();
+    async_queue_dispatch_all(NULL, NULL);
+    ASSERT_EQ(hold.calls, 1);
+    ASSERT_EQ(timer_service_timeout(), -1);
+
+    /* Keys push it back; none in INSERT mode */
+    autocmd_note_input();
+    autocmd_note_input();
+    ctx.view.mode = MODE_INSERT;
+    nanosleep(&ts, NULL);
+    timer_service_run();
+    async_queue_dispatch_all(NULL, NULL);
+    ASSERT_EQ(hold.calls, 1);
+    ASSERT_EQ(other_timers, 0);
+
+    ctx.view.mode = MODE_NORMAL;
+    autocmd_note_input();
+    autocmd_del(id);
+    autocmd_note_input();
+    ASSERT_EQ(timer_service_timeout(), -1);
+
+    autocmd_set_hold_ms(AUTOCMD_HOLD_MS);
+    editor_ctx_free(&ctx);
+    timer_service_cleanup();
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("Autocommands")
+    RUN_TEST(autocmd_event_names);
+    RUN_TEST(autocmd_pattern_kinds);
+    RUN_TEST(autocmd_fire_by_event_and_pattern);
+    RUN_TEST(autocmd_changes_while_firing);
+    RUN_TEST(autocmd_read_write_and_filetype);
+    RUN_TEST(autocmd_insert_leave);
+    RUN_TEST(autocmd_cursor_hold_by_timer);
+END_TEST_SUITE()
@@ -0,0 +1,274 @@
+/* test_bsearch.c - Unit tests for searching every open buffer
+ *
+ * Tests for:
+ * - Matches from every buffer, in buffer order
+ * - Plain text, case and the match limit
+ * - Many buffers searched at once, indexed ones included
+ * - Buffers sharing a document searched once
+ * - Stepping through the :bsearch list across buffers
+ * - A session without the buffer list, and errors
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "buffers.h"
+#include "bsearch.h"
+#include "search_index.h"
+#include <stdio.h>
+#include <string.h>
+
+/* The first buffer, as the editor starts */
+static void init_buffers(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    buffers_init(ctx);
+}
+
+/* Replace buffer 'id's rows with the '\n'-separated lines of 'text' */
+static void fill_buffer(int id, const char *text) {
+    editor_ctx_t *ctx = buffer_get(id);
+    while (ctx->model.numrows) editor_del_row(ctx, 0);
+    for (const char *p = text; *p; ) {
+        const char *nl = strchr(p, '\n');
+        size_t len = nl ? (size_t)(nl - p) : strlen(p);
+        editor_insert_row(ctx, ctx->model.numrows, (char *)p, len);
+        p += len + (nl ? 1 : 0);
+    }
+    ctx->model.dirty = 0;
+}
+
+/* Three buffers; "error" is in the first and the third */
+static void init_logs(editor_ctx_t *ctx, int ids[3]) {
+    init_buffers(ctx);
+    ids[0] = buffer_get_current_id();
+    ids[1] = buffer_create(NULL);
+    ids[2] = buffer_create(NULL);
+    fill_buffer(ids[0], "start\nerror: disk\nok\nerror: net error");
+    fill_buffer(ids[1], "all fine\nnothing here");
+    fill_buffer(ids[2], "Error: late\nerror");
+    buffer_switch(ids[0]);
+}
+
+/* ======================= Searching ========================================= */
+
+TEST(bsearch_run_finds_matches_in_buffer_order) {
+    editor_ctx_t ctx;
+    int ids[3];
+    init_logs(&ctx, ids);
+
+    BufferMatches bm;
+    const char *error = NULL;
+    ASSERT_EQ(bsearch_run(buffer_get_current(), "err+or", 0, 0, &bm, &error), 4);
+    ASSERT_EQ(bm.buffers, 3);
+    ASSERT_EQ(bm.m[0].buffer_id, ids[0]);
+    ASSERT_EQ(bm.m[0].row, 1);
+    ASSERT_EQ(bm.m[0].off, 0);
+    ASSERT_EQ(bm.m[0].len, 5);
+    ASSERT_EQ(bm.m[1].row, 3);
+    ASSERT_EQ(bm.m[1].off, 0);
+    ASSERT_EQ(bm.m[2].row, 3);              /* Second in the same row */
+    ASSERT_EQ(bm.m[2].off, 11);
+    ASSERT_EQ(bm.m[3].buffer_id, ids[2]);   /* "Error" differs in case */
+    ASSERT_EQ(bm.m[3].row, 1);
+    bsearch_matches_free(&bm);
+    buffers_free();
+}
+
+TEST(bsearch_run_takes_plain_text_case_and_a_limit) {
+    editor_ctx_t ctx;
+    int ids[3];
+    init_logs(&ctx, ids);
+    editor_ctx_t *cur = buffer_get_current();
+    BufferMatches bm;
+    const char *error = NULL;
+
+    /* ':' and '.' are themselves */
+    fill_buffer(ids[1], "a.b: x\naxb: y");
+    ASSERT_EQ(bsearch_run(cur, "a.b:", BSEARCH_LITERAL, 0, &bm, &error), 1);
+    ASSERT_EQ(bm.m[0].buffer_id, ids[1]);
+    bsearch_matches_free(&bm);
+
+    ASSERT_EQ(bsearch_run(cur, "ERROR", BSEARCH_LITERAL | BSEARCH_ICASE, 0,
+                          &bm, &error), 5);
+    bsearch_matches_free(&bm);
+
+    /* :set ignorecase, unless the flags say otherwise */
+    cur->view.ignore_case = 1;
+    ASSERT_EQ(bsearch_run(cur, "error", 0, 0, &bm, &error), 5);
+    bsearch_matches_free(&bm);
+    ASSERT_EQ(bsearch_run(cur, "error", BSEARCH_CASE, 0, &bm, &error), 4);
+    bsearch_matches_free(&bm);
+    cur->view.ignore_case = 0;
+
+    /* The first matches in buffer order */
+    ASSERT_EQ(bsearch_run(cur, "error", 0, 2, &bm, &error), 2);
+    ASSERT_EQ(bm.m[1].buffer_id, ids[0]);
+    bsearch_matches_free(&bm);
+    buffers_free();
+}
+
+TEST(bsearch_run_searches_many_buffers_at_once) {
+    editor_ctx_t ctx;
+    init_buffers(&ctx);
+    int ids[40];
+    ids[0] = buffer_get_current_id();
+    for (int b = 1; b < 40; b++) ids[b] = buffer_create(NULL);
+
+    /* Every buffer has "needle" in row b; the last ones are long and
+     * indexed */
+    for (int b = 0; b < 40; b++) {
+        editor_ctx_t *c = buffer_get(ids[b]);
+        ASSERT_NOT_NULL(c);
+        editor_del_row(c, 0);
+        int rows = b >= 36 ? 20000 : 200;
+        for (int r = 0; r < rows; r++) {
+            char line[64];
+            int n = snprintf(line, sizeof(line), "log line %d%s", r,
+                             r == b ? " needle" : "");
+            editor_insert_row(c, r, line, (size_t)n);
+        }
+        if (b >= 36) {
+            search_index_enable(&c->model);
+            search_index_wait(&c->model);
+        }
+    }
+
+    BufferMatches bm;
+    const char *error = NULL;
+    ASSERT_EQ(bsearch_run(buffer_get_current(), "needle", BSEARCH_LITERAL, 0,
+                          &bm, &error), 40);
+    ASSERT_EQ(bm.buffers, 40);
+    for (int b = 0; b < 40; b++) {
+        ASSERT_EQ(bm.m[b].buffer_id, ids[b]);
+        ASSERT_EQ(bm.m[b].row, b);
+    }
+    bsearch_matches_free(&bm);
+
+    ASSERT_EQ(bsearch_run(buffer_get_current(), "line 1[0-9]* needle", 0, 0,
+                          &bm, &error), 11);
+    bsearch_matches_free(&bm);
+    buffers_free();
+}
+
+TEST(bsearch_run_searches_a_shared_document_once) {
+    editor_ctx_t ctx;
+    int ids[3];
+    init_logs(&ctx, ids);
+    int view = buffer_create_view(ids[0]);
+    ASSERT_TRUE(view > 0);
+
+    BufferMatches bm;
+    const char *error = NULL;
+    ASSERT_EQ(bsearch_run(buffer_get_current(), "err+or", 0, 0, &bm, &error), 4);
+    ASSERT_EQ(bm.buffers, 3);
+    ASSERT_EQ(bm.m[0].buffer_id, ids[0]);
+    bsearch_matches_free(&bm);
+    buffers_free();
+}
+
+/* ======================= The Match List ==================================== */
+
+TEST(bsearch_jump_steps_through_buffers) {
+    editor_ctx_t ctx;
+    int ids[3];
+    init_logs(&ctx, ids);
+
+    ASSERT_EQ(bsearch_start(buffer_get_current(), "error", 0), 0);
+    int current;
+    ASSERT_EQ(bsearch_list(&current)->n, 4);
+    ASSERT_EQ(current, 0);
+    editor_ctx_t *c = buffer_get_current();
+    ASSERT_EQ(buffer_get_current_id(), ids[0]);
+    ASSERT_EQ(c->view.rowoff + c->view.cy, 1);
+    ASSERT_STR_EQ(c->view.statusmsg, "[No Name]:2:1 (match 1 of 4)");
+
+    bsearch_jump(c, 1);
+    bsearch_jump(c, 1);
+    ASSERT_EQ(c->view.cx, 11);
+    ASSERT_EQ(bsearch_jump(c, 1), 0);
+    c = buffer_get_current();
+    ASSERT_EQ(buffer_get_current_id(), ids[2]);
+    ASSERT_EQ(c->view.rowoff + c->view.cy, 1);
+
+    /* Around the end, and back */
+    bsearch_jump(c, 1);
+    ASSERT_EQ(buffer_get_current_id(), ids[0]);
+    bsearch_jump(buffer_get_current(), -1);
+    ASSERT_EQ(buffer_get_current_id(), ids[2]);
+
+    /* A closed buffer's matches are passed over; rows edited away too */
+    buffer_switch(ids[0]);
+    buffer_close(ids[2], 1);
+    fill_buffer(ids[0], "error");
+    bsearch_jump(buffer_get_current(), 1);
+    bsearch_list(&current);
+    ASSERT_EQ(current, 0);
+    bsearch_jump(buffer_get_current(), 1);
+    bsearch_list(&current);
+    ASSERT_EQ(current, 1);
+    c = buffer_get_current();
+    ASSERT_EQ(c->view.rowoff + c->view.cy, 0);
+    ASSERT_EQ(c->view.cx, 0);
+
+    bsearch_clear();
+    buffers_free();
+}
+
+/* ======================= Sessions and Errors =============================== */
+
+TEST(bsearch_searches_the_one_buffer_without_a_list) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "one two", 7);
+    editor_insert_row(&ctx, 1, "two", 3);
+
+    BufferMatches bm;
+    const char *error = NULL;
+    ASSERT_EQ(bsearch_run(&ctx, "two", 0, 0, &bm, &error), 2);
+    ASSERT_EQ(bm.m[0].buffer_id, -1);
+    bsearch_matches_free(&bm);
+
+    ASSERT_EQ(bsearch_start(&ctx, "two", 0), 0);
+    bsearch_jump(&ctx, 1);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 1);
+    bsearch_clear();
+    editor_ctx_free(&ctx);
+}
+
+TEST(bsearch_reports_bad_patterns_and_no_matches) {
+    editor_ctx_t ctx;
+    int ids[3];
+    init_logs(&ctx, ids);
+    editor_ctx_t *c = buffer_get_current();
+    BufferMatches bm;
+    const char *error = NULL;
+
+    ASSERT_EQ(bsearch_run(c, "(", 0, 0, &bm, &error), -1);
+    ASSERT_NOT_NULL(error);
+    bsearch_matches_free(&bm);
+
+    ASSERT_EQ(bsearch_start(c, "(", 0), -1);
+    ASSERT_TRUE(strncmp(c->view.statusmsg, "bsearch: ", 9) == 0);
+    ASSERT_EQ(bsearch_start(c, "giraffe", 0), -1);
+    ASSERT_STR_EQ(c->view.statusmsg, "bsearch: No matches in 3 buffers");
+    ASSERT_EQ(bsearch_jump(c, 1), -1);
+    ASSERT_EQ(buffer_get_current_id(), ids[0]);
+    buffers_free();
+}
+
+BEGIN_TEST_SUITE("Buffer Search")
+    /* Searching */
+    RUN_TEST(bsearch_run_finds_matches_in_buffer_order);
+    RUN_TEST(bsearch_run_takes_plain_text_case_and_a_limit);
+    RUN_TEST(bsearch_run_searches_many_buffers_at_once);
+    RUN_TEST(bsearch_run_searches_a_shared_document_once);
+
+    /* The match list */
+    RUN_TEST(bsearch_jump_steps_through_buffers);
+
+    /* Sessions and errors */
+    RUN_TEST(bsearch_searches_the_one_buffer_without_a_list);
+    RUN_TEST(bsearch_reports_bad_patterns_and_no_matches);
+END_TEST_SUITE()
@@ -1,14 +1,39 @@
 /* test_buffers.c - Unit tests for multiple buffer management
  *
- * Tests buffer creation, switching, closing, and tab rendering.
+ * Tests buffer creation, switching, closing, lookups with hundreds of
+ * buffers open, lazy loading and eviction, reading files in the
+ * background, buffers sharing a document, and tab rendering.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
 #include "buffers.h"
+#include "undo.h"
+#include "undo_journal.h"
+#include "async_queue.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define TEST_DIR "/tmp/loki_buffers_test"
+
+/* Helper: Write 'content' to TEST_DIR/name; returns its path */
+static const char *write_file(const char *name, const char *content) {
+    static char path[256];
+    mkdir(TEST_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/%s", TEST_DIR, name);
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fputs(content, f);
+        fclose(f);
+    }
+    return path;
+}
 
 /* Helper: Initialize a minimal editor context for testing */
 static void init_test_context(editor_ctx_t *ctx) {
@@ -184,38 +209,286 @@ TEST(buffer_list) {
     int id2 = buffer_create(NULL);
     int id3 = buffer_create(NULL);
 
-    int ids[MAX_BUFFERS];
-    int count = buffer_get_list(ids);
+    int ids[3];
+    int count = buffer_get_list(ids, 3);
 
     ASSERT_EQ(count, 3);
     ASSERT_EQ(ids[0], id1);
     ASSERT_EQ(ids[1], id2);
     ASSERT_EQ(ids[2], id3);
+    ASSERT_EQ(buffer_get_list(ids, 2), 2);
+    ASSERT_EQ(buffer_get_id_at(1), id2);
+    ASSERT_EQ(buffer_get_id_at(3), -1);
 
     buffers_free();
 }
 
-/* Test: Maximum buffers limit */
-TEST(buffer_limit) {
+/* Test: No fixed limit on open buffers */
+TEST(buffer_many) {
     editor_ctx_t ctx;
     init_test_context(&ctx);
 
     buffers_init(&ctx);
 
-    /* Create MAX_BUFFERS - 1 more buffers (already have 1) */
-    for (int i = 1; i < MAX_BUFFERS; i++) {
-        int id = buffer_create(NULL);
-        ASSERT_TRUE(id > 0);
+    enum { N = 300 };
+    int ids[N];
+    ids[0] = buffer_get_current_id();
+    for (int i = 1; i < N; i++) {
+        ids[i] = buffer_create(NULL);
+        ASSERT_TRUE(ids[i] > 0);
+    }
+    ASSERT_EQ(buffer_count(), N);
+
+    /* Close every third buffer; the rest are still found and in order */
+    for (int i = 0; i < N; i += 3) ASSERT_EQ(buffer_close(ids[i], 0), 0);
+    ASSERT_EQ(buffer_count(), N - N / 3);
+    int at = 0;
+    for (int i = 0; i < N; i++) {
+        if (i % 3 == 0) {
+            ASSERT_NULL(buffer_get(ids[i]));
+            continue;
+        }
+        ASSERT_NOT_NULL(buffer_get(ids[i]));
+        ASSERT_EQ(buffer_get_id_at(at), ids[i]);
+        at++;
     }
 
-    ASSERT_EQ(buffer_count(), MAX_BUFFERS);
+    /* Contexts stay where they are as buffers open and close */
+    editor_ctx_t *last = buffer_get(ids[N - 1]);
+    ASSERT_EQ(buffer_switch(ids[N - 1]), 0);
+    for (int i = 0; i < N; i++) buffer_create(NULL);
+    ASSERT_TRUE(buffer_get_current() == last);
+    ASSERT_EQ(buffer_next(), ids[N - 1] + 1);
+
+    buffers_free();
+}
+
+/* Test: Files are read when their buffer is first shown */
+TEST(buffer_lazy_load) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
 
-    /* Try to create one more - should fail */
-    int overflow_id = buffer_create(NULL);
-    ASSERT_EQ(overflow_id, -1);
-    ASSERT_EQ(buffer_count(), MAX_BUFFERS);
+    buffers_init(&ctx);
+
+    int id1 = buffer_get_current_id();
+    int id2 = buffer_create(write_file("lazy.txt", "one\ntwo\n"));
+    ASSERT_TRUE(id2 > 0);
+    ASSERT_EQ(buffer_get_state(id2), BUFFER_UNREAD);
+    ASSERT_STR_EQ(buffer_get_display_name(id2), "lazy.txt");
+    ASSERT_EQ(buffer_is_modified(id2), 0);
+
+    ASSERT_EQ(buffer_switch(id2), 0);
+    ASSERT_EQ(buffer_get_state(id2), BUFFER_LOADED);
+    editor_ctx_t *c = buffer_get_current();
+    ASSERT_EQ(c->model.numrows, 2);
+    ASSERT_STR_EQ(c->model.row[1].chars, "two");
+
+    /* buffer_get() reads it too */
+    int id3 = buffer_create(write_file("other.txt", "three\n"));
+    ASSERT_STR_EQ(buffer_get(id3)->model.row[0].chars, "three");
+    ASSERT_EQ(buffer_get_current_id(), id2);
+
+    ASSERT_EQ(buffer_create(TEST_DIR "/missing.txt"), -1);
+    ASSERT_EQ(buffer_switch(id1), 0);
+
+    buffers_free();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+/* Test: Background buffers give up their rows under the budget */
+TEST(buffer_eviction) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
+
+    buffers_init(&ctx);
+    buffers_set_memory_budget(1);  /* Only the current buffer stays */
+
+    int id1 = buffer_get_current_id();
+    const char *path = write_file("clean.txt", "alpha\nbeta\n");
+    int clean = buffer_create(path);
+    int dirty = buffer_create(write_file("dirty.txt", "gamma\n"));
+
+    /* Clean buffers are read again from their file, cursor kept */
+    buffer_switch(clean);
+    buffer_get_current()->view.cy = 1;
+    buffer_switch(id1);
+    ASSERT_EQ(buffer_get_state(clean), BUFFER_EVICTED);
+    buffer_switch(clean);
+    editor_ctx_t *c = buffer_get_current();
+    ASSERT_EQ(buffer_get_state(clean), BUFFER_LOADED);
+    ASSERT_EQ(c->model.numrows, 2);
+    ASSERT_STR_EQ(c->model.row[0].chars, "alpha");
+    ASSERT_EQ(c->view.cy, 1);
+    ASSERT_EQ(buffer_get_state(id1), BUFFER_SPILLED);  /* Unnamed */
+
+    /* Modified ones are spilled, with their edits and history */
+    buffer_switch(dirty);
+    c = buffer_get_current();
+    c->view.cx = 5;
+    c->view.cy = 0;
+    editor_insert_char(c, '!');
+    buffer_switch(clean);
+    ASSERT_EQ(buffer_get_state(dirty), BUFFER_SPILLED);
+    ASSERT_EQ(buffer_is_modified(dirty), 1);
+    buffer_switch(dirty);
+    c = buffer_get_current();
+    ASSERT_STR_EQ(c->model.row[0].chars, "gamma!");
+    ASSERT_TRUE(c->model.dirty);
+    ASSERT_EQ(undo_perform(c), 1);
+    ASSERT_STR_EQ(c->model.row[0].chars, "gamma");
+
+    /* A file changed since it was evicted is read afresh */
+    write_file("clean.txt", "changed on disk\n");
+    buffer_switch(clean);
+    c = buffer_get_current();
+    ASSERT_EQ(c->model.numrows, 1);
+    ASSERT_STR_EQ(c->model.row[0].chars, "changed on disk");
+
+    /* No budget: nothing is evicted */
+    buffers_set_memory_budget(0);
+    buffer_switch(id1);
+    ASSERT_EQ(buffer_get_state(clean), BUFFER_LOADED);
+
+    buffers_free();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+/* Handle events until a buffer is no longer being read */
+static void wait_prefetch(int id) {
+    for (int i = 0; i < 5000 && buffer_get_state(id) == BUFFER_READING; i++) {
+        struct timespec ts = {0, 1000000};
+        async_queue_dispatch_all(NULL, NULL);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Test: Files are read on worker threads ahead of being shown */
+TEST(buffer_prefetch) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
+
+    buffers_init(&ctx);
+
+    /* No event queue: files wait to be shown */
+    int id = buffer_create(write_file("a.txt", "alpha\n"));
+    ASSERT_EQ(buffers_prefetch(), 0);
+    ASSERT_EQ(buffer_get_state(id), BUFFER_UNREAD);
+
+    ASSERT_EQ(async_queue_init(), 0);
+    int ids[3] = { id, buffer_create(write_file("b.txt", "beta\ngamma\n")),
+                   buffer_create(write_file("c.txt", "delta\n")) };
+    int gone = buffer_create(write_file("d.txt", "epsilon\n"));
+    ASSERT_EQ(buffers_prefetch(), 4);
+    ASSERT_EQ(buffers_prefetch(), 0);        /* All being read already */
+    ASSERT_EQ(buffer_close(gone, 0), 0);     /* Its read goes unused */
+
+    /* Shown while being read, or read already */
+    ASSERT_EQ(buffer_switch(ids[1]), 0);
+    ASSERT_EQ(buffer_get_state(ids[1]), BUFFER_LOADED);
+    editor_ctx_t *c = buffer_get_current();
+    ASSERT_EQ(c->model.numrows, 2);
+    ASSERT_STR_EQ(c->model.row[1].chars, "gamma");
+    ASSERT_EQ(c->model.dirty, 0);
+
+    /* The others come in with their events */
+    wait_prefetch(ids[0]);
+    wait_prefetch(ids[2]);
+    ASSERT_EQ(buffer_get_state(ids[0]), BUFFER_LOADED);
+    ASSERT_EQ(buffer_get_state(ids[2]), BUFFER_LOADED);
+    ASSERT_STR_EQ(buffer_get(ids[2])->model.row[0].chars, "delta");
+
+    /* Reads that do not fit the budget are left for later */
+    buffers_set_memory_budget(1);
+    int big = buffer_create(write_file("e.txt", "zeta\n"));
+    ASSERT_EQ(buffers_prefetch(), 1);
+    wait_prefetch(big);
+    ASSERT_EQ(buffer_get_state(big), BUFFER_UNREAD);
+    ASSERT_EQ(buffer_switch(big), 0);
+    ASSERT_STR_EQ(buffer_get_current()->model.row[0].chars, "zeta");
+    buffers_set_memory_budget(BUFFERS_DEFAULT_BUDGET);
+
+    /* Reads still going when the buffers go are waited for */
+    buffer_create(write_file("f.txt", "eta\n"));
+    buffers_prefetch();
+    buffers_free();
+    async_queue_dispatch_all(NULL, NULL);    /* Stale events are ignored */
+    async_queue_cleanup();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+/* Test: Buffers on one file share its document, each with its own view */
+TEST(buffer_shared_document) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
+
+    buffers_init(&ctx);
+
+    int id1 = buffer_get_current_id();
+    const char *path = write_file("shared.txt", "first\nsecond\n");
+    int a = buffer_create(path);
+    int b = buffer_create(path);
+    ASSERT_TRUE(a > 0 && b > 0 && a != b);
+    ASSERT_EQ(buffer_view_count(a), 2);
+    ASSERT_EQ(buffer_view_count(id1), 1);
+    ASSERT_TRUE(buffer_get(a) == buffer_get(b));
+    ASSERT_STR_EQ(buffer_get_display_name(b), "shared.txt");
+
+    /* Own cursors; an edit in one shows in the other */
+    buffer_switch(a);
+    editor_ctx_t *c = buffer_get_current();
+    c->view.cy = 1;
+    buffer_switch(b);
+    ASSERT_TRUE(buffer_get_current() == c);
+    ASSERT_EQ(c->view.cy, 0);
+    c->view.cx = 5;
+    editor_insert_char(c, '!');
+    buffer_switch(a);
+    ASSERT_EQ(c->view.cy, 1);
+    ASSERT_STR_EQ(c->model.row[0].chars, "first!");
+    ASSERT_EQ(buffer_is_modified(a), 1);
+
+    /* One undo history */
+    ASSERT_EQ(undo_perform(c), 1);
+    ASSERT_STR_EQ(c->model.row[0].chars, "first");
+    ASSERT_EQ(redo_perform(c), 1);
+
+    /* A view shown again draws its frame whole */
+    c->frame.valid = 1;
+    buffer_switch(b);
+    ASSERT_EQ(c->frame.valid, 0);
+    c->frame.valid = 1;
+    buffer_switch(a);
+    ASSERT_EQ(c->frame.valid, 0);
+
+    /* A copy of a view starts where it is */
+    c->view.cy = 1;
+    int v = buffer_create_view(a);
+    buffer_switch(v);
+    ASSERT_EQ(c->view.cy, 1);
+    ASSERT_EQ(buffer_view_count(a), 3);
+
+    /* Closing one loses nothing; the last one warns */
+    ASSERT_EQ(buffer_close(v, 0), 0);
+    ASSERT_EQ(buffer_close(a, 0), 0);
+    ASSERT_EQ(buffer_view_count(b), 1);
+    ASSERT_EQ(buffer_get_current_id(), id1);  /* Next after v, wrapping */
+    ASSERT_EQ(c->view.cx, 6);               /* b's view in the context */
+    ASSERT_STR_EQ(buffer_get(b)->model.row[0].chars, "first!");
+    ASSERT_EQ(buffer_close(b, 0), 1);
+    ASSERT_EQ(buffer_close(b, 1), 0);
+
+    ASSERT_EQ(buffer_create_view(12345), -1);  /* No such buffer */
 
     buffers_free();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
 }
 
 /* Test: Buffer tab rendering */
@@ -254,6 +527,10 @@ BEGIN_TEST_SUITE("Buffer Management")
     RUN_TEST(buffer_modified);
     RUN_TEST(buffer_display_name);
     RUN_TEST(buffer_list);
-    RUN_TEST(buffer_limit);
+    RUN_TEST(buffer_many);
+    RUN_TEST(buffer_lazy_load);
+    RUN_TEST(buffer_eviction);
+    RUN_TEST(buffer_prefetch);
+    RUN_TEST(buffer_shared_document);
     RUN_TEST(buffer_tabs_rendering);
 END_TEST_SUITE()
@@ -0,0 +1,179 @@
+/* test_changes.c - Unit tests for batched edit records
+ *
+ * Tests for:
+ * - A burst of typing on one line delivered as one record
+ * - Records of scattered edits that, applied top down to the old rows,
+ *   give the new ones
+ * - Batches held for the watch's interval, and at most one per tick
+ * - Watches stopped and released; a buffer's rows replaced
+ */
+
+#include "test_framework.h"
+#include "changes.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Got {
+    ChangeRecord records[CHANGES_MAX_SPANS];
+    int count;
+    int calls;
+    editor_ctx_t *edit;         /* Edited by the call, if not NULL */
+} Got;
+
+static void got_batch(EditorModel *model, const ChangeRecord *records,
+                      int count, void *opaque) {
+    Got *got = opaque;
+    (void)model;
+    memcpy(got->records, records, (size_t)count * sizeof(ChangeRecord));
+    got->count = count;
+    got->calls++;
+    if (got->edit) editor_insert_row(got->edit, 0, "again", 5);
+}
+
+static int released = 0;
+
+static void release(void *opaque) {
+    (void)opaque;
+    released++;
+}
+
+static void fill(editor_ctx_t *ctx, int n) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    char line[16];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "row %d", i);
+        editor_insert_row(ctx, i, line, (size_t)len);
+    }
+}
+
+TEST(changes_typing_is_one_record) {
+    editor_ctx_t ctx;
+    fill(&ctx, 5);
+    Got got = {0};
+    changes_watch(&ctx.model, 0, got_batch, NULL, &got);
+    editor_cursor_to(&ctx, 2, 5);
+    for (int i = 0; i < 10; i++) editor_insert_char(&ctx, 'x');
+    ASSERT_EQ(changes_gen(&ctx.model), 10);
+    ASSERT_EQ(changes_flush(&ctx.model), 1);
+    ASSERT_EQ(got.count, 1);
+    ASSERT_EQ(got.records[0].row, 2);
+    ASSERT_EQ(got.records[0].old_count, 1);
+    ASSERT_EQ(got.records[0].new_count, 1);
+    ASSERT_EQ(got.records[0].gen, 10);
+    ASSERT_EQ(changes_flush(&ctx.model), 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(changes_records_apply_top_down) {
+    editor_ctx_t ctx;
+    fill(&ctx, 40);
+    char *old[40];
+    for (int i = 0; i < 40; i++) old[i] = strdup(ctx.model.row[i].chars);
+    Got got = {0};
+    changes_watch(&ctx.model, 0, got_batch, NULL, &got);
+
+    editor_del_rows(&ctx, 30, 3);
+    editor_insert_row(&ctx, 20, "new a", 5);
+    editor_insert_row(&ctx, 21, "new b", 5);
+    editor_cursor_to(&ctx, 5, 0);
+    editor_insert_newline(&ctx);
+    editor_del_row(&ctx, 0);
+    editor_row_set(&ctx, &ctx.model.row[10], "changed", 7);
+    changes_flush(&ctx.model);
+    ASSERT_TRUE(got.count >= 4);
+
+    /* The old rows, with each record's rows replaced by the new ones */
+    char *rows[64];
+    int n = 40;
+    memcpy(rows, old, sizeof(old));
+    for (int i = 0; i < got.count; i++) {
+        const ChangeRecord *r = &got.records[i];
+        if (i > 0) ASSERT_TRUE(r->row > got.records[i - 1].row);
+        memmove(&rows[r->row + r->new_count], &rows[r->row + r->old_count],
+                (size_t)(n - r->row - r->old_count) * sizeof(char *));
+        for (int j = 0; j < r->new_count; j++)
+            rows[r->row + j] = ctx.model.row[r->row + j].chars;
+        n += r->new_count - r->old_count;
+    }
+    ASSERT_EQ(n, ctx.model.numrows);
+    for (int i = 0; i < n; i++) ASSERT_STR_EQ(rows[i], ctx.model.row[i].chars);
+    for (int i = 0; i < 40; i++) free(old[i]);
+    editor_ctx_free(&ctx);
+}
+
+TEST(changes_tick_waits_for_interval) {
+    editor_ctx_t ctx;
+    fill(&ctx, 3);
+    Got got = {0};
+    changes_watch(&ctx.model, 10, got_batch, NULL, &got);
+    uint64_t now = 1000000000;
+    ASSERT_EQ(changes_tick(now), -1);
+
+    editor_row_set(&ctx, &ctx.model.row[1], "a", 1);
+    ASSERT_EQ(changes_tick(now), 10);
+    editor_row_set(&ctx, &ctx.model.row[1], "ab", 2);
+    ASSERT_EQ(changes_tick(now + 4000000), 6);
+    ASSERT_EQ(got.calls, 0);
+    ASSERT_EQ(changes_tick(now + 10000000), -1);
+    ASSERT_EQ(got.calls, 1);
+    ASSERT_EQ(got.count, 1);
+    ASSERT_EQ(got.records[0].gen, 2);
+
+    /* A call that edits its own buffer gets that batch next tick: a row
+     * put before row 0 is row 0 becoming rows 0..1 */
+    Got self = { .edit = &ctx };
+    changes_watch(&ctx.model, 0, got_batch, NULL, &self);
+    editor_row_set(&ctx, &ctx.model.row[0], "b", 1);
+    ASSERT_EQ(changes_tick(now), 0);
+    ASSERT_EQ(self.calls, 1);
+    ASSERT_EQ(changes_tick(now), 0);
+    ASSERT_EQ(self.calls, 2);
+    ASSERT_EQ(self.records[0].row, 0);
+    ASSERT_EQ(self.records[0].old_count, 1);
+    ASSERT_EQ(self.records[0].new_count, 2);
+    editor_ctx_free(&ctx);
+}
+
+TEST(changes_unwatch_and_reset) {
+    editor_ctx_t ctx;
+    fill(&ctx, 3);
+    Got a = {0}, b = {0};
+    released = 0;
+    int ida = changes_watch(&ctx.model, 0, got_batch, release, &a);
+    int idb = changes_watch(&ctx.model, 0, got_batch, release, &b);
+    ASSERT_TRUE(ida > 0 && idb > ida);
+
+    editor_row_set(&ctx, &ctx.model.row[2], "x", 1);
+    changes_note_reset(&ctx.model);
+    editor_insert_row(&ctx, 3, "y", 1);
+    changes_flush(&ctx.model);
+    ASSERT_EQ(a.count, 1);
+    ASSERT_EQ(a.records[0].row, 0);
+    ASSERT_EQ(a.records[0].old_count, -1);
+    ASSERT_EQ(a.records[0].new_count, 4);
+    ASSERT_EQ(b.calls, 1);
+
+    ASSERT_EQ(changes_unwatch(ida), 0);
+    ASSERT_EQ(changes_unwatch(ida), -1);
+    ASSERT_EQ(released, 1);
+    editor_row_set(&ctx, &ctx.model.row[0], "z", 1);
+    changes_flush(&ctx.model);
+    ASSERT_EQ(a.calls, 1);
+    ASSERT_EQ(b.calls, 2);
+
+    /* The last one goes with the buffer; its edits are noted no more */
+    editor_ctx_free(&ctx);
+    ASSERT_EQ(released, 2);
+    ASSERT_EQ(changes_unwatch(idb), -1);
+    ASSERT_EQ(changes_tick(0), -1);
+}
+
+BEGIN_TEST_SUITE("Change records")
+    RUN_TEST(changes_typing_is_one_record);
+    RUN_TEST(changes_records_apply_top_down);
+    RUN_TEST(changes_tick_waits_for_interval);
+    RUN_TEST(changes_unwatch_and_reset);
+END_TEST_SUITE()
@@ -0,0 +1,169 @@
+/* test_columns.c - Unit tests for column mode
+ *
+ * Tests for:
+ * - Fields laid out to the widths of their columns, and display columns
+ * - Widths growing and shrinking as rows are indexed, changed and deleted
+ * - Delimiters inside double quotes, and TAB
+ * - Large ranges indexed on the pool
+ * - :columns, :sort by a column and :columns select
+ */
+
+#include "test_framework.h"
+#include "columns.h"
+#include "command.h"
+#include "internal.h"
+#include "multicursor.h"
+#include <stdio.h>
+#include <string.h>
+
+static int layout(ColumnIndex *ci, int row, const char *s, const ColumnField **fields) {
+    return columns_layout(ci, row, s, (int)strlen(s), fields);
+}
+
+TEST(columns_layout_lines_up) {
+    ColumnIndex *ci = columns_new(',');
+    const ColumnField *f;
+    const char *a = "a,bbb,c", *b = "dddd,e";
+    ASSERT_EQ(layout(ci, 0, a, &f), 3);
+    ASSERT_EQ(layout(ci, 1, b, &f), 2);
+    ASSERT_EQ(columns_width(ci, 0), 4);
+    ASSERT_EQ(columns_width(ci, 1), 3);
+    ASSERT_EQ(columns_count(ci), 3);
+
+    /* Row 0 again, with row 1 widening its first column */
+    ASSERT_EQ(layout(ci, 0, a, &f), 3);
+    ASSERT_EQ(f[1].start, 2);
+    ASSERT_EQ(f[1].len, 3);
+    ASSERT_EQ(f[0].col, 0);
+    ASSERT_EQ(f[1].col, 5);
+    ASSERT_EQ(f[2].col, 9);
+    ASSERT_EQ(columns_display_col(f, 3, a, 0), 0);
+    ASSERT_EQ(columns_display_col(f, 3, a, 1), 4);    /* The delimiter */
+    ASSERT_EQ(columns_display_col(f, 3, a, 3), 6);
+    ASSERT_EQ(columns_display_col(f, 3, a, 7), 10);   /* End of the row */
+    ASSERT_EQ(columns_field_at(f, 3, 5), 1);
+    ASSERT_EQ(columns_indexed_rows(ci), 2);
+    columns_free(ci);
+}
+
+TEST(columns_widths_follow_edits) {
+    ColumnIndex *ci = columns_new(',');
+    const ColumnField *f;
+    layout(ci, 0, "a,b", &f);
+    layout(ci, 1, "wide field,b", &f);
+    ASSERT_EQ(columns_width(ci, 0), 10);
+    unsigned long gen = columns_gen(ci);
+
+    /* The wide row changed: its fields are gone until drawn again */
+    columns_note_change(ci, 1);
+    ASSERT_EQ(columns_width(ci, 0), 1);
+    ASSERT_TRUE(columns_gen(ci) != gen);
+    layout(ci, 1, "abc,b", &f);
+    ASSERT_EQ(columns_width(ci, 0), 3);
+
+    /* A row inserted above moves the entries down */
+    columns_note_insert(ci, 0);
+    ASSERT_EQ(columns_indexed_rows(ci), 2);
+    int len;
+    ASSERT_EQ(columns_field(ci, 2, "abc,b", 5, 1, &len), 4);
+    ASSERT_EQ(columns_indexed_rows(ci), 2);
+    columns_note_delete(ci, 2);
+    ASSERT_EQ(columns_indexed_rows(ci), 1);
+    ASSERT_EQ(columns_width(ci, 0), 1);
+
+    /* Very wide fields count as COLUMNS_WIDTH_MAX */
+    char wide[COLUMNS_WIDTH_MAX * 2 + 1];
+    memset(wide, 'x', sizeof(wide) - 1);
+    wide[sizeof(wide) - 1] = '\0';
+    layout(ci, 3, wide, &f);
+    ASSERT_EQ(f[0].width, COLUMNS_WIDTH_MAX * 2);
+    ASSERT_EQ(columns_width(ci, 0), COLUMNS_WIDTH_MAX);
+    columns_note_delete_rows(ci, 0, 4);
+    ASSERT_EQ(columns_indexed_rows(ci), 0);
+    ASSERT_EQ(columns_count(ci), 0);
+    columns_free(ci);
+}
+
+TEST(columns_quotes_and_tabs) {
+    ColumnIndex *ci = columns_new(',');
+    const ColumnField *f;
+    ASSERT_EQ(layout(ci, 0, "\"x,y\",z", &f), 2);
+    ASSERT_EQ(f[1].start, 6);
+    columns_free(ci);
+
+    ci = columns_new('\t');
+    ASSERT_EQ(layout(ci, 0, "\"x\ty\",z", &f), 2);
+    ASSERT_EQ(f[1].start, 3);
+    columns_free(ci);
+
+    ASSERT_EQ(columns_delim_for_path("data.csv"), ',');
+    ASSERT_EQ(columns_delim_for_path("dir/data.tsv"), '\t');
+    ASSERT_EQ(columns_delim_for_path("notes.txt"), 0);
+    ASSERT_EQ(columns_delim_for_path(NULL), 0);
+}
+
+TEST(columns_index_many_rows) {
+    int n = COLUMNS_PARALLEL_MIN + 5;
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[32];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "%d,row,%s", i, i == n - 1 ? "last" : "x");
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+    ColumnIndex *ci = columns_new(',');
+    columns_index_rows(ci, ctx.model.row, 0, n - 1);
+    ASSERT_EQ(columns_indexed_rows(ci), n);
+    ASSERT_EQ(columns_count(ci), 3);
+    ASSERT_EQ(columns_width(ci, 0), 5);
+    ASSERT_EQ(columns_width(ci, 2), 4);
+    int len;
+    ASSERT_EQ(columns_field(ci, 12345, ctx.model.row[12345].chars,
+                            ctx.model.row[12345].size, 1, &len), 6);
+    ASSERT_EQ(len, 3);
+    columns_free(ci);
+    editor_ctx_free(&ctx);
+}
+
+TEST(columns_commands) {
+    const char *lines[] = { "b,3", "a,10,extra", "c,2", "d" };
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < 4; i++)
+        editor_insert_row(&ctx, i, (char *)lines[i], strlen(lines[i]));
+
+    ASSERT_FALSE(command_execute(&ctx, ":sort n 2"));
+    ASSERT_TRUE(command_execute(&ctx, ":columns"));
+    ASSERT_TRUE(ctx.model.columns != NULL);
+    ASSERT_EQ(columns_delim(ctx.model.columns), ',');
+    ASSERT_EQ(ctx.view.word_wrap, 0);
+
+    /* By the second field as a number; "d" has none */
+    ASSERT_TRUE(command_execute(&ctx, ":sort n 2"));
+    const char *sorted[] = { "d", "c,2", "b,3", "a,10,extra" };
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, sorted[i]);
+    ASSERT_TRUE(command_execute(&ctx, ":sort 1"));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "a,10,extra");
+
+    /* A cursor at the second field of each row that has one */
+    ASSERT_TRUE(command_execute(&ctx, ":columns select 2"));
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 0);
+    ASSERT_EQ(ctx.view.coloff + ctx.view.cx, 2);
+    ASSERT_EQ(multicursor_count(&ctx), 2);
+    ASSERT_FALSE(command_execute(&ctx, ":columns select 0"));
+
+    ASSERT_TRUE(command_execute(&ctx, ":columns tab"));
+    ASSERT_EQ(columns_delim(ctx.model.columns), '\t');
+    ASSERT_FALSE(command_execute(&ctx, ":columns x"));
+    ASSERT_TRUE(command_execute(&ctx, ":columns off"));
+    ASSERT_TRUE(ctx.model.columns == NULL);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Columns")
+    RUN_TEST(columns_layout_lines_up);
+    RUN_TEST(columns_widths_follow_edits);
+    RUN_TEST(columns_quotes_and_tabs);
+    RUN_TEST(columns_index_many_rows);
+    RUN_TEST(columns_commands);
+END_TEST_SUITE()
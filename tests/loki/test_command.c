@@ -5,7 +5,11 @@
  * - Command input handling
  * - Command execution (:w, :q, :set, etc.)
  * - Command history navigation
- * - Command parsing
+ * - Command parsing, abbreviations and Tab completion
+ * - Commands registered by the hundred
+ * - Substitution over line ranges, and pattern addresses (/re/, ?re?)
+ * - Line deletion (:d) and the global commands (:g, :v)
+ * - Undo tree commands (:undo N, :earlier, :later)
  */
 
 #include "test_framework.h"
@@ -13,6 +17,12 @@
 #include "internal.h"
 #include "command.h"
 #include "buffers.h"
+#include "terminal.h"
+#include "frame_pacer.h"
+#include "undo.h"
+#include "async_queue.h"
+#include "memstats.h"
+#include "perfhud.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -51,8 +61,7 @@ static void init_cmd_ctx_with_content(editor_ctx_t *ctx, const char *content) {
     ctx->model.row[0].size = strlen(content);
     ctx->model.row[0].render = strdup(content);
     ctx->model.row[0].rsize = strlen(content);
-    ctx->model.row[0].hl = NULL;
-    ctx->model.row[0].idx = 0;
+    ctx->model.row[0].hl_buf.hl = NULL;
 }
 
 /* Helper: Free command test context */
@@ -358,6 +367,72 @@ TEST(cmd_execute_set_wrap) {
     free_cmd_ctx(&ctx);
 }
 
+TEST(cmd_execute_set_sync) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    int result = command_execute(&ctx, ":set sync=on");
+    ASSERT_EQ(result, 1);
+    ASSERT_EQ(terminal_get_sync_mode(), TERM_SYNC_ON);
+    ASSERT_TRUE(terminal_sync_enabled());
+
+    result = command_execute(&ctx, ":set sync = off");
+    ASSERT_EQ(result, 1);
+    ASSERT_FALSE(terminal_sync_enabled());
+
+    result = command_execute(&ctx, ":set sync=maybe");
+    ASSERT_EQ(result, 0);
+    ASSERT_EQ(terminal_get_sync_mode(), TERM_SYNC_OFF);
+
+    terminal_set_sync_mode(TERM_SYNC_AUTO);
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_execute_set_fps) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":set fps=60"), 1);
+    ASSERT_EQ(frame_pacer_get_rate(), 60);
+
+    ASSERT_EQ(command_execute(&ctx, ":set fps=0"), 1);
+    ASSERT_EQ(frame_pacer_get_rate(), 0);
+
+    ASSERT_EQ(command_execute(&ctx, ":set fps=fast"), 0);
+    ASSERT_EQ(command_execute(&ctx, ":set fps=-5"), 0);
+    ASSERT_EQ(frame_pacer_get_rate(), 0);
+
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_execute_set_hlsearch) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    int initial = ctx.view.hl_search;
+    int result = command_execute(&ctx, ":set hlsearch");
+
+    ASSERT_EQ(result, 1);
+    ASSERT_EQ(ctx.view.hl_search, !initial);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "Highlight all matches") != NULL);
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_execute_set_perfhud) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":set perfhud"), 1);
+    ASSERT_TRUE(perfhud_enabled());
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "Performance HUD: on") != NULL);
+    ASSERT_EQ(command_execute(&ctx, ":set perfhud"), 1);
+    ASSERT_FALSE(perfhud_enabled());
+
+    free_cmd_ctx(&ctx);
+}
+
 TEST(cmd_execute_set_unknown_option) {
     editor_ctx_t ctx;
     init_cmd_ctx(&ctx);
@@ -424,6 +499,463 @@ TEST(cmd_edit_requires_filename) {
     free_cmd_ctx(&ctx);
 }
 
+/* ============================================================================
+ * Substitute Tests
+ * ============================================================================ */
+
+TEST(cmd_substitute_replaces_first_regex_match) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "id 12, id 345");
+
+    int result = command_execute(&ctx, ":s/[0-9]+/N/");
+
+    ASSERT_EQ(result, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "id N, id 345");
+    ASSERT_EQ(ctx.model.row[0].size, 12);
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_global_with_match_and_escapes) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "a/b c/d");
+
+    /* & is the match, \& a literal &, \/ a slash in the pattern */
+    int result = command_execute(&ctx, ":s/\\w\\/\\w/[&]\\&/g");
+
+    ASSERT_EQ(result, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "[a/b]& [c/d]&");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_steps_over_empty_matches) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "abc");
+
+    int result = command_execute(&ctx, ":s/x*/-/g");
+
+    ASSERT_EQ(result, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "-a-b-c-");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_reports_invalid_pattern) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "abc");
+
+    int result = command_execute(&ctx, ":s/a(/x/");
+
+    ASSERT_EQ(result, 0);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "Invalid pattern") != NULL);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abc");
+
+    free_cmd_ctx(&ctx);
+}
+
+/* Helper: Create context with the rows "<prefix>1" .. "<prefix>n" */
+static void init_cmd_ctx_with_rows(editor_ctx_t *ctx, const char *prefix, int n) {
+    init_cmd_ctx(ctx);
+    for (int i = 0; i < n; i++) {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "%s%d", prefix, i + 1);
+        editor_insert_row(ctx, i, line, (size_t)len);
+    }
+}
+
+TEST(cmd_substitute_whole_buffer_and_line_ranges) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "row ", 5);
+
+    ASSERT_EQ(command_execute(&ctx, ":%s/row/line/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line 1");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "line 5");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "5 substitutions on 5 lines");
+
+    ASSERT_EQ(command_execute(&ctx, ":2,3s/line/L/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line 1");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "L 2");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "L 3");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "line 4");
+
+    /* '.' is the cursor's line, '$' the last, with offsets */
+    ctx.view.cy = 3;
+    ASSERT_EQ(command_execute(&ctx, ":.,$s/line/x/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "x 4");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "x 5");
+    ASSERT_EQ(command_execute(&ctx, ":$-4s/ /_/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line_1");
+
+    /* Nothing changes on a bad range */
+    ASSERT_EQ(command_execute(&ctx, ":3,9s/L/M/"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Invalid range");
+    ASSERT_EQ(command_execute(&ctx, ":3,2s/L/M/"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Backwards range");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "L 3");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_on_the_last_visual_selection) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "a", 4);
+
+    ASSERT_EQ(command_execute(&ctx, ":'<,'>s/a/b/"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Mark not set");
+
+    ctx.view.vmark_set = 1;
+    ctx.view.vmark_start = editor_mark_add(&ctx.model, 1, 0, 0);
+    ctx.view.vmark_end = editor_mark_add(&ctx.model, 2, 0, 0);
+    ASSERT_EQ(command_execute(&ctx, ":'<,'>s/a/b/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "a1");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "b2");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "b3");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "a4");
+
+    /* The marks stay on their lines when one is inserted above them */
+    editor_insert_row(&ctx, 0, "a0", 2);
+    ASSERT_EQ(command_execute(&ctx, ":'<,'>s/b/c/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "c2");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "c3");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_range_is_one_undo_step) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "ab ", 50);
+    undo_clear(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":%s/b/xyz/g"), 1);
+    ASSERT_STR_EQ(ctx.model.row[49].chars, "axyz 50");
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    for (int i = 0; i < 50; i++) {
+        char line[16];
+        snprintf(line, sizeof(line), "ab %d", i + 1);
+        ASSERT_STR_EQ(ctx.model.row[i].chars, line);
+    }
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "axyz 1");
+    ASSERT_STR_EQ(ctx.model.row[49].chars, "axyz 50");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_builds_long_lines) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+    char *line = malloc(10000);
+    memset(line, 'a', 10000);
+    editor_insert_row(&ctx, 0, line, 10000);
+    free(line);
+
+    ASSERT_EQ(command_execute(&ctx, ":s/a/bc/g"), 1);
+    ASSERT_EQ(ctx.model.row[0].size, 20000);
+    ASSERT_EQ(ctx.model.row[0].chars[19999], 'c');
+    ASSERT_STR_EQ(ctx.view.statusmsg, "10000 substitutions");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_substitute_follows_ignorecase) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "Foo foo FOO");
+
+    ASSERT_EQ(command_execute(&ctx, ":set ignorecase"), 1);
+    ASSERT_EQ(ctx.view.ignore_case, 1);
+    ASSERT_EQ(command_execute(&ctx, ":s/foo/x/g"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "x x x");
+
+    /* I: match case exactly after all */
+    ASSERT_EQ(command_execute(&ctx, ":s/X/y/I"), 0);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "x x x");
+
+    ASSERT_EQ(command_execute(&ctx, ":set smartcase"), 1);
+    ASSERT_EQ(command_execute(&ctx, ":s/X/y/"), 0);
+    ASSERT_EQ(command_execute(&ctx, ":s/x/y/"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "y x x");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_range_alone_goes_to_its_line) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "row ", 5);
+
+    ASSERT_EQ(command_execute(&ctx, ":$"), 1);
+    ASSERT_EQ(ctx.view.cy, 4);
+    ASSERT_EQ(command_execute(&ctx, ":2"), 1);
+    ASSERT_EQ(ctx.view.cy, 1);
+
+    ASSERT_EQ(command_execute(&ctx, ":1,2w"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "No range allowed");
+
+    free_cmd_ctx(&ctx);
+}
+
+/* Helper: the buffer's lines joined by '|' */
+static const char *joined_rows(editor_ctx_t *ctx) {
+    static char out[4096];
+    size_t n = 0;
+    out[0] = '\0';
+    for (int i = 0; i < ctx->model.numrows && n < sizeof(out) - 1; i++)
+        n += (size_t)snprintf(out + n, sizeof(out) - n, "%s%s", i ? "|" : "",
+                              ctx->model.row[i].chars);
+    return out;
+}
+
+TEST(cmd_delete_lines_of_a_range) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "row ", 6);
+    undo_clear(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":2,3d"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 1|row 4|row 5|row 6");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "2 fewer lines");
+    ASSERT_EQ(ctx.view.cy, 1);
+
+    /* A count from the line */
+    ASSERT_EQ(command_execute(&ctx, ":d 2"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 1|row 6");
+    ASSERT_EQ(command_execute(&ctx, ":$d"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 1");
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 1|row 2|row 3|row 4|row 5|row 6");
+
+    ASSERT_EQ(command_execute(&ctx, ":%d"), 1);
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_pattern_addresses) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "row ", 6);
+
+    /* Forward from the cursor, wrapping around, or backward with ?re? */
+    ASSERT_EQ(command_execute(&ctx, ":/row 4/"), 1);
+    ASSERT_EQ(ctx.view.cy, 3);
+    ASSERT_EQ(command_execute(&ctx, ":/row 2/"), 1);
+    ASSERT_EQ(ctx.view.cy, 1);
+    ASSERT_EQ(command_execute(&ctx, ":?5?"), 1);
+    ASSERT_EQ(ctx.view.cy, 4);
+
+    ASSERT_EQ(command_execute(&ctx, ":/6/"), 1);
+    ASSERT_EQ(command_execute(&ctx, ":/1/+1,/4/d"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 1|row 5|row 6");
+
+    ASSERT_EQ(command_execute(&ctx, ":/nothing/d"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Pattern not found: nothing");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_global_deletes_matching_lines) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "row ", 12);
+    undo_clear(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":g/1/d"), 1);     /* 1, 10, 11, 12 */
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 2|row 3|row 4|row 5|row 6|row 7|row 8|row 9");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "4 fewer lines");
+
+    ASSERT_EQ(command_execute(&ctx, ":v/[2468]/d"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 2|row 4|row 6|row 8");
+    ASSERT_EQ(command_execute(&ctx, ":g!/[48]/d"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "row 4|row 8");
+
+    /* Each one undo step */
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 12);
+    ASSERT_STR_EQ(ctx.model.row[11].chars, "row 12");
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    /* Within a range, and every line at once */
+    ASSERT_EQ(command_execute(&ctx, ":2,10g/1/d"), 1);
+    ASSERT_EQ(ctx.model.numrows, 11);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "row 1");
+    ASSERT_STR_EQ(ctx.model.row[9].chars, "row 11");
+    ASSERT_EQ(command_execute(&ctx, ":g/row/d"), 1);
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_global_substitutes_on_matching_lines) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_rows(&ctx, "a,b ", 6);
+    undo_clear(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":g/[135]$/s/,/;/"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "a;b 1|a,b 2|a;b 3|a,b 4|a;b 5|a,b 6");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "3 substitutions on 3 lines");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    ASSERT_EQ(command_execute(&ctx, ":g/a/m0"), 0);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "Not supported") != NULL);
+    ASSERT_EQ(command_execute(&ctx, ":g/zzz/d"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Pattern not found: zzz");
+    ASSERT_EQ(command_execute(&ctx, ":g/2/"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "1 line");
+    ASSERT_STR_EQ(joined_rows(&ctx), "a,b 1|a,b 2|a,b 3|a,b 4|a,b 5|a,b 6");
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_reindent_buffer_and_range) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+    const char *lines[] = {"f() {", "a;", "if (x) {", "b;", "}", "}"};
+    for (int i = 0; i < 6; i++)
+        editor_insert_row(&ctx, i, (char *)lines[i], strlen(lines[i]));
+
+    ASSERT_EQ(command_execute(&ctx, ":2,2reindent"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "f() {|    a;|if (x) {|b;|}|}");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "1 line reindented");
+
+    ASSERT_EQ(command_execute(&ctx, ":reindent"), 1);
+    ASSERT_STR_EQ(joined_rows(&ctx), "f() {|    a;|    if (x) {|        b;|    }|}");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "3 lines reindented");
+
+    ASSERT_EQ(command_execute(&ctx, ":reindent"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Indentation unchanged");
+
+    free_cmd_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Grep Tests
+ * ============================================================================ */
+
+TEST(cmd_grep_lists_matches_in_a_new_buffer) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+    setup_test_dir();
+    FILE *fp = fopen(TEST_DIR "/a.txt", "w");
+    fputs("one\nHello World\nthree\n", fp);
+    fclose(fp);
+
+    int result = command_execute(&ctx, ":grep -i \"hello world\" " TEST_DIR);
+
+    ASSERT_EQ(result, 1);
+    editor_ctx_t *results = buffer_get_current();
+    ASSERT_EQ(buffer_count(), 2);
+    ASSERT_EQ(results->model.numrows, 2);
+    ASSERT_STR_EQ(results->model.row[1].chars,
+                  TEST_DIR "/a.txt:2:1: Hello World");
+    ASSERT_EQ(results->model.dirty, 0);
+    ASSERT_TRUE(strstr(results->view.statusmsg, "1 match in 1 file") != NULL);
+
+    cleanup_test_dir();
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_grep_reports_invalid_pattern) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    int result = command_execute(&ctx, ":grep a( /tmp");
+
+    ASSERT_EQ(result, 0);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "grep:") != NULL);
+    ASSERT_EQ(buffer_count(), 1);
+
+    free_cmd_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Statistics Command Tests
+ * ============================================================================ */
+
+TEST(cmd_stats_async_lists_timings_in_a_new_buffer) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    ASSERT_EQ(command_execute(&ctx, ":stats async"), 0);    /* No queue */
+    ASSERT_EQ(command_execute(&ctx, ":stats memory"), 0);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "Usage") != NULL);
+
+    ASSERT_EQ(async_queue_init(), 0);
+    ASSERT_EQ(async_queue_push_timer(NULL, 1, NULL), 0);
+    async_queue_dispatch_all(NULL, NULL);
+    ASSERT_EQ(command_execute(&ctx, ":stats async"), 1);
+    editor_ctx_t *report = buffer_get_current();
+    ASSERT_EQ(buffer_count(), 2);
+    ASSERT_EQ(report->model.numrows, 3);    /* Depth, TIMER and its waits */
+    ASSERT_TRUE(strncmp(report->model.row[1].chars, "TIMER (1): 1 dispatched", 23) == 0);
+    ASSERT_EQ(report->model.dirty, 0);
+
+    ASSERT_EQ(command_execute(&ctx, ":stats async reset"), 1);
+    ASSERT_EQ(async_queue_get_type_stats(NULL, ASYNC_EVENT_TIMER, NULL, NULL), -1);
+    async_queue_cleanup();
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_stats_mem_reports_buffer_rows) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+    editor_insert_row(&ctx, 0, "one", 3);
+    editor_insert_row(&ctx, 1, "two", 3);
+
+    ASSERT_EQ(command_execute(&ctx, ":stats mem"), 1);
+    editor_ctx_t *report = buffer_get_current();
+    ASSERT_EQ(report->model.numrows, memstats_enabled() ? MEM_TAGS + 2 : 2);
+    ASSERT_TRUE(strncmp(report->model.row[0].chars, "Memory by subsystem", 19) == 0);
+    ASSERT_TRUE(strncmp(report->model.row[report->model.numrows - 1].chars,
+                        "Buffer rows: 2,", 15) == 0);
+    ASSERT_EQ(report->model.dirty, 0);
+
+    free_cmd_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Undo Tree Command Tests
+ * ============================================================================ */
+
+TEST(cmd_undo_moves_through_the_undo_tree) {
+    editor_ctx_t ctx;
+    init_cmd_ctx_with_content(&ctx, "");
+
+    /* "a" (state 1), "ab" (2), then "ac" (3) on a branch from 1 */
+    const char *typed = "abc";
+    for (int i = 0; i < 3; i++) {
+        ctx.view.cx = ctx.model.row[0].size;
+        undo_break_group(&ctx);
+        editor_insert_char(&ctx, typed[i]);
+        if (i == 1) undo_perform(&ctx);
+    }
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+
+    ASSERT_EQ(command_execute(&ctx, ":undo 2"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ab");
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Undo state 2 of 3");
+    ASSERT_EQ(command_execute(&ctx, ":earlier 2"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    ASSERT_EQ(command_execute(&ctx, ":later 1h"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+    ASSERT_EQ(command_execute(&ctx, ":earlier 1d"), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+
+    ASSERT_EQ(command_execute(&ctx, ":undo 7"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "undo: State 7 is not kept");
+    ASSERT_EQ(command_execute(&ctx, ":later 3x"), 0);
+
+    free_cmd_ctx(&ctx);
+}
+
 /* ============================================================================
  * Command History Tests
  * ============================================================================ */
@@ -569,6 +1101,25 @@ TEST(cmd_execute_alias_h_for_help) {
     free_cmd_ctx(&ctx);
 }
 
+TEST(cmd_execute_abbreviation) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+    ctx.model.dirty = 1;
+
+    /* :qui is short for :quit, not for :quit! */
+    ASSERT_EQ(command_execute(&ctx, ":qui"), 0);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "nsaved") != NULL);
+
+    ASSERT_EQ(command_execute(&ctx, ":hel goto"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, ":goto - Go to line number");
+
+    /* :re could be :recover or :redo */
+    ASSERT_EQ(command_execute(&ctx, ":re"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Ambiguous command: re");
+
+    free_cmd_ctx(&ctx);
+}
+
 /* ============================================================================
  * Dynamic Command Registration Tests
  * ============================================================================ */
@@ -630,6 +1181,83 @@ TEST(cmd_unregister_all_clears_dynamic) {
     command_unregister_all_dynamic();
 }
 
+TEST(cmd_register_many_commands) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    char name[32];
+    for (int i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "plugin%03d", i);
+        ASSERT_EQ(command_register(name, test_handler, "Plugin command", 0, 0), 1);
+    }
+    ASSERT_EQ(command_register("plugin250", test_handler, "Again", 0, 0), 0);
+    ASSERT_EQ(command_execute(&ctx, ":plugin499"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Test handler called");
+
+    const command_def_t *out[4];
+    ASSERT_EQ(command_complete("plugin1", out, 4), 100);
+    ASSERT_STR_EQ(out[0]->name, "plugin100");
+    ASSERT_STR_EQ(out[3]->name, "plugin103");
+    ASSERT_EQ(command_complete("plugin42", out, 4), 10);
+
+    command_unregister_all_dynamic();
+    ASSERT_EQ(command_complete("plugin", out, 4), 0);
+    ASSERT_EQ(command_execute(&ctx, ":plugin499"), 0);
+    ASSERT_EQ(command_complete("w", out, 4), 3);        /* w, wq, write */
+
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_abbreviation_prefers_builtins) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    command_register("helpme", test_handler, "Plugin help", 0, 0);
+    command_register("zzplugin", test_handler, "Plugin", 0, 0);
+    ASSERT_EQ(command_execute(&ctx, ":hel goto"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, ":goto - Go to line number");
+    ASSERT_EQ(command_execute(&ctx, ":zz"), 1);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Test handler called");
+
+    command_register("zzother", test_handler, "Plugin", 0, 0);
+    ASSERT_EQ(command_execute(&ctx, ":zz"), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Ambiguous command: zz");
+
+    command_unregister_all_dynamic();
+    free_cmd_ctx(&ctx);
+}
+
+TEST(cmd_mode_tab_completes_command_name) {
+    editor_ctx_t ctx;
+    init_cmd_ctx(&ctx);
+
+    command_mode_enter(&ctx);
+    command_mode_handle_key(&ctx, 0, 'g');
+    command_mode_handle_key(&ctx, 0, 'r');
+    command_mode_handle_key(&ctx, 0, TAB);
+    ASSERT_STR_EQ(ctx.view.cmd_buffer, ":grep");
+    ASSERT_EQ(ctx.view.cmd_cursor_pos, 5);
+
+    /* As far as :bsearch, :bsnext and :bsprev agree */
+    command_mode_exit(&ctx);
+    command_mode_enter(&ctx);
+    command_mode_handle_key(&ctx, 0, 'b');
+    command_mode_handle_key(&ctx, 0, TAB);
+    ASSERT_STR_EQ(ctx.view.cmd_buffer, ":bs");
+    command_mode_handle_key(&ctx, 0, 'n');
+    command_mode_handle_key(&ctx, 0, TAB);
+    ASSERT_STR_EQ(ctx.view.cmd_buffer, ":bsnext");
+
+    /* Not once arguments are being typed */
+    command_mode_handle_key(&ctx, 0, ' ');
+    command_mode_handle_key(&ctx, 0, 'x');
+    command_mode_handle_key(&ctx, 0, TAB);
+    ASSERT_STR_EQ(ctx.view.cmd_buffer, ":bsnext x");
+
+    command_mode_exit(&ctx);
+    free_cmd_ctx(&ctx);
+}
+
 BEGIN_TEST_SUITE("Command Mode")
     /* Enter/Exit */
     RUN_TEST(cmd_mode_enter_sets_mode);
@@ -654,11 +1282,43 @@ BEGIN_TEST_SUITE("Command Mode")
     RUN_TEST(cmd_execute_help_shows_message);
     RUN_TEST(cmd_execute_help_specific_command);
     RUN_TEST(cmd_execute_set_wrap);
+    RUN_TEST(cmd_execute_set_sync);
+    RUN_TEST(cmd_execute_set_fps);
+    RUN_TEST(cmd_execute_set_hlsearch);
+    RUN_TEST(cmd_execute_set_perfhud);
     RUN_TEST(cmd_execute_set_unknown_option);
     RUN_TEST(cmd_write_requires_filename_when_new);
     RUN_TEST(cmd_write_saves_file);
     RUN_TEST(cmd_edit_requires_filename);
 
+    /* Substitute */
+    RUN_TEST(cmd_substitute_replaces_first_regex_match);
+    RUN_TEST(cmd_substitute_global_with_match_and_escapes);
+    RUN_TEST(cmd_substitute_steps_over_empty_matches);
+    RUN_TEST(cmd_substitute_reports_invalid_pattern);
+    RUN_TEST(cmd_substitute_whole_buffer_and_line_ranges);
+    RUN_TEST(cmd_substitute_on_the_last_visual_selection);
+    RUN_TEST(cmd_substitute_range_is_one_undo_step);
+    RUN_TEST(cmd_substitute_builds_long_lines);
+    RUN_TEST(cmd_substitute_follows_ignorecase);
+    RUN_TEST(cmd_range_alone_goes_to_its_line);
+    RUN_TEST(cmd_delete_lines_of_a_range);
+    RUN_TEST(cmd_pattern_addresses);
+    RUN_TEST(cmd_global_deletes_matching_lines);
+    RUN_TEST(cmd_global_substitutes_on_matching_lines);
+    RUN_TEST(cmd_reindent_buffer_and_range);
+
+    /* Grep */
+    RUN_TEST(cmd_grep_lists_matches_in_a_new_buffer);
+    RUN_TEST(cmd_grep_reports_invalid_pattern);
+
+    /* Statistics */
+    RUN_TEST(cmd_stats_async_lists_timings_in_a_new_buffer);
+    RUN_TEST(cmd_stats_mem_reports_buffer_rows);
+
+    /* Undo tree */
+    RUN_TEST(cmd_undo_moves_through_the_undo_tree);
+
     /* History */
     RUN_TEST(cmd_history_tracks_length);
     RUN_TEST(cmd_history_stores_commands);
@@ -671,10 +1331,14 @@ BEGIN_TEST_SUITE("Command Mode")
     RUN_TEST(cmd_execute_alias_quit);
     RUN_TEST(cmd_execute_alias_write);
     RUN_TEST(cmd_execute_alias_h_for_help);
+    RUN_TEST(cmd_execute_abbreviation);
 
     /* Dynamic registration */
     RUN_TEST(cmd_register_custom_command);
     RUN_TEST(cmd_register_duplicate_fails);
     RUN_TEST(cmd_register_builtin_override_fails);
     RUN_TEST(cmd_unregister_all_clears_dynamic);
+    RUN_TEST(cmd_register_many_commands);
+    RUN_TEST(cmd_abbreviation_prefers_builtins);
+    RUN_TEST(cmd_mode_tab_completes_command_name);
 END_TEST_SUITE()
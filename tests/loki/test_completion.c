@@ -0,0 +1,151 @@
+/* test_completion.c - Unit tests for the completion index
+ *
+ * Tests for:
+ * - The words with a prefix, and what they all start with
+ * - Queries: prefix matches shortest first, then fuzzy ones by score
+ * - Syncing a source dropping what it no longer gives, and words held by
+ *   several sources
+ * - Removing words, and words taken from text
+ * - Tens of thousands of words
+ */
+
+#include "test_framework.h"
+#include "completion.h"
+#include <uv.h>
+#include <stdio.h>
+#include <string.h>
+
+static void add_all(CompletionIndex *ix, const char **words, int n, int source) {
+    for (int i = 0; i < n; i++) completion_index_add(ix, words[i], strlen(words[i]), source);
+}
+
+TEST(completion_prefix_and_common) {
+    CompletionIndex *ix = completion_index_new();
+    const char *words[] = {"string.format", "print", "string.find", "pairs", "string.fill"};
+    add_all(ix, words, 5, COMPLETION_SOURCE_LUA);
+    completion_index_add(ix, "print", 5, COMPLETION_SOURCE_LUA);
+    ASSERT_EQ(completion_index_count(ix), 5);
+
+    int first;
+    size_t common;
+    ASSERT_EQ(completion_index_prefix(ix, "str", 3, &first, &common), 3);
+    ASSERT_STR_EQ(completion_index_word(ix, first), "string.fill");
+    ASSERT_EQ(common, strlen("string.f"));
+
+    ASSERT_EQ(completion_index_prefix(ix, "pr", 2, &first, &common), 1);
+    ASSERT_STR_EQ(completion_index_word(ix, first), "print");
+    ASSERT_EQ(completion_index_prefix(ix, "x", 1, &first, &common), 0);
+    ASSERT_EQ(common, 1);
+    ASSERT_EQ(completion_index_prefix(ix, "", 0, &first, NULL), 5);
+
+    completion_index_free(ix);
+}
+
+TEST(completion_query_ranks) {
+    CompletionIndex *ix = completion_index_new();
+    const char *words[] = {"printf", "print", "print_all", "sprint", "pairs",
+                           "string.format", "stuff.fmt_stamp", "os.time"};
+    add_all(ix, words, 8, COMPLETION_SOURCE_LUA);
+
+    const char *out[8];
+    int n = completion_index_query(ix, "pri", 3, out, 8);
+    ASSERT_EQ(n, 4);
+    ASSERT_STR_EQ(out[0], "print");
+    ASSERT_STR_EQ(out[1], "printf");
+    ASSERT_STR_EQ(out[2], "print_all");
+    ASSERT_STR_EQ(out[3], "sprint");        /* Fuzzy, after the prefixes */
+
+    /* The characters in order, best where they run on or start parts */
+    n = completion_index_query(ix, "sfmt", 4, out, 8);
+    ASSERT_EQ(n, 2);
+    ASSERT_STR_EQ(out[0], "stuff.fmt_stamp");
+    ASSERT_STR_EQ(out[1], "string.format");
+
+    ASSERT_EQ(completion_index_query(ix, "zq", 2, out, 8), 0);
+    ASSERT_EQ(completion_index_query(ix, "pri", 3, out, 2), 2);
+    ASSERT_STR_EQ(out[1], "printf");
+
+    completion_index_free(ix);
+}
+
+TEST(completion_sync_sweeps_source) {
+    CompletionIndex *ix = completion_index_new();
+    const char *lua[] = {"alpha", "beta", "gamma"};
+    add_all(ix, lua, 3, COMPLETION_SOURCE_LUA);
+    completion_index_add(ix, "beta", 4, COMPLETION_SOURCE_BUFFER);
+
+    /* Again, without alpha and beta, and with new words sorted in */
+    completion_index_begin(ix, COMPLETION_SOURCE_LUA);
+    const char *again[] = {"gamma", "zeta", "delta", "zeta"};
+    add_all(ix, again, 4, COMPLETION_SOURCE_LUA);
+    ASSERT_EQ(completion_index_count(ix), 3);   /* New ones wait for the end */
+    completion_index_end(ix, COMPLETION_SOURCE_LUA);
+
+    ASSERT_EQ(completion_index_count(ix), 4);
+    const char *want[] = {"beta", "delta", "gamma", "zeta"};
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(completion_index_word(ix, i), want[i]);
+
+    /* The buffer still held beta; an empty sync lets it go */
+    completion_index_begin(ix, COMPLETION_SOURCE_BUFFER);
+    completion_index_end(ix, COMPLETION_SOURCE_BUFFER);
+    ASSERT_EQ(completion_index_count(ix), 3);
+    ASSERT_STR_EQ(completion_index_word(ix, 0), "delta");
+
+    completion_index_free(ix);
+}
+
+TEST(completion_remove_and_text) {
+    CompletionIndex *ix = completion_index_new();
+    const char *text = "local note_on = 60 -- x 2nd play(note_on, _vel)";
+    completion_index_add_text(ix, text, strlen(text), COMPLETION_SOURCE_BUFFER, 3);
+    ASSERT_EQ(completion_index_count(ix), 4);
+    const char *want[] = {"_vel", "local", "note_on", "play"};
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(completion_index_word(ix, i), want[i]);
+
+    completion_index_add(ix, "play", 4, COMPLETION_SOURCE_LUA);
+    completion_index_remove(ix, "play", 4, COMPLETION_SOURCE_BUFFER);
+    ASSERT_EQ(completion_index_count(ix), 4);
+    completion_index_remove(ix, "play", 4, COMPLETION_SOURCE_LUA);
+    completion_index_remove(ix, "missing", 7, COMPLETION_SOURCE_LUA);
+    ASSERT_EQ(completion_index_count(ix), 3);
+    ASSERT_NULL(completion_index_word(ix, 3));
+
+    completion_index_free(ix);
+}
+
+TEST(completion_many_words) {
+    CompletionIndex *ix = completion_index_new();
+    char word[64];
+    completion_index_begin(ix, COMPLETION_SOURCE_BUFFER);
+    for (int i = 0; i < 50000; i++) {
+        int k = (i * 7919) % 50000;     /* Each of 0..49999, out of order */
+        int n = snprintf(word, sizeof(word), "w%05d_%s", k, k % 2 ? "odd" : "even");
+        completion_index_add(ix, word, (size_t)n, COMPLETION_SOURCE_BUFFER);
+    }
+    completion_index_end(ix, COMPLETION_SOURCE_BUFFER);
+    ASSERT_EQ(completion_index_count(ix), 50000);
+
+    int first;
+    ASSERT_EQ(completion_index_prefix(ix, "w123", 4, &first, NULL), 100);
+    ASSERT_STR_EQ(completion_index_word(ix, first), "w12300_even");
+
+    /* Queries rank the lot quickly (a loose bound, for slow builds) */
+    const char *out[10];
+    uint64_t start = uv_hrtime();
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(completion_index_query(ix, "w4999", 5, out, 10), 10);
+        ASSERT_EQ(completion_index_query(ix, "w9d", 3, out, 10), 10);
+    }
+    ASSERT_TRUE(uv_hrtime() - start < 2000000000ULL);
+    ASSERT_STR_EQ(out[0], "w00009_odd");
+
+    completion_index_free(ix);
+}
+
+BEGIN_TEST_SUITE("Completion")
+    RUN_TEST(completion_prefix_and_common);
+    RUN_TEST(completion_query_ranks);
+    RUN_TEST(completion_sync_sweeps_source);
+    RUN_TEST(completion_remove_and_text);
+    RUN_TEST(completion_many_words);
+END_TEST_SUITE()
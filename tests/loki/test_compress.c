@@ -0,0 +1,226 @@
+/* test_compress.c - Unit tests for gzip and zstd files
+ *
+ * Tests for:
+ * - Telling formats by magic number and by file name
+ * - Loading gzip (one member, several, BGZF blocks in parallel) and zstd
+ *   files as their text, and damaged ones as they are
+ * - Saving to .gz and .zst names compressed
+ */
+
+#include "test_framework.h"
+#include "compress.h"
+#include "loader.h"
+#include "save.h"
+#include "internal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef LOKI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define TEST_GZ "/tmp/loki_test_compress.gz"
+#define TEST_ZST "/tmp/loki_test_compress.zst"
+
+/* Lines of text, 'n' of them */
+static char *make_text(int n, size_t *len) {
+    char *text = malloc((size_t)n * 32);
+    size_t at = 0;
+    for (int i = 0; i < n; i++) at += (size_t)sprintf(text + at, "log line %d\n", i);
+    *len = at;
+    return text;
+}
+
+/* Write 'len' bytes at 'data' to 'path' through a writer of 'format' */
+static int write_compressed(const char *path, CompressFormat format,
+                            const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CompressWriter *w = compress_writer_open(format, fd);
+    if (!w) {
+        close(fd);
+        return -1;
+    }
+    /* In pieces, as the rows come */
+    int ret = 0;
+    for (size_t at = 0; at < len && ret == 0; at += 1000)
+        ret = compress_writer_write(w, data + at, len - at < 1000 ? len - at : 1000);
+    if (compress_writer_close(w) == -1) ret = -1;
+    close(fd);
+    return ret;
+}
+
+/* Whether 'path' loads as the 'len' bytes at 'text', decompressed */
+static int loads_as(const char *path, const char *text, size_t len) {
+    LoadedFile file;
+    if (loader_open(path, &file) == -1) return 0;
+    int same = file.compressed != 0 && file.size == len &&
+               memcmp(file.data, text, len) == 0;
+    loader_close(&file);
+    return same;
+}
+
+TEST(compress_tells_formats) {
+    ASSERT_EQ(compress_detect("\x1f\x8b\x08", 3), COMPRESS_GZIP);
+    ASSERT_EQ(compress_detect("\x28\xb5\x2f\xfd", 4), COMPRESS_ZSTD);
+    ASSERT_EQ(compress_detect("\x28\xb5", 2), COMPRESS_NONE);
+    ASSERT_EQ(compress_detect("text", 4), COMPRESS_NONE);
+    ASSERT_EQ(compress_format_for_path("app.log.gz"), COMPRESS_GZIP);
+    ASSERT_EQ(compress_format_for_path("reads.bgz"), COMPRESS_GZIP);
+    ASSERT_EQ(compress_format_for_path("app.log.zst"), COMPRESS_ZSTD);
+    ASSERT_EQ(compress_format_for_path("app.log"), COMPRESS_NONE);
+    ASSERT_EQ(compress_format_for_path(".gz"), COMPRESS_NONE);
+    ASSERT_TRUE(compress_supported(COMPRESS_NONE));
+}
+
+#ifdef LOKI_HAVE_ZLIB
+TEST(compress_loads_gzip_members) {
+    size_t len;
+    char *text = make_text(20000, &len);
+    ASSERT_EQ(write_compressed(TEST_GZ, COMPRESS_GZIP, text, len), 0);
+    ASSERT_TRUE(loads_as(TEST_GZ, text, len));
+
+    /* Two members, as by cat a.gz b.gz */
+    FILE *fp = fopen(TEST_GZ, "rb");
+    char *gz = malloc(len);
+    size_t gzlen = fread(gz, 1, len, fp);
+    fclose(fp);
+    fp = fopen(TEST_GZ, "ab");
+    fwrite(gz, 1, gzlen, fp);
+    fclose(fp);
+    char *twice = malloc(len * 2);
+    memcpy(twice, text, len);
+    memcpy(twice + len, text, len);
+    ASSERT_TRUE(loads_as(TEST_GZ, twice, len * 2));
+
+    /* Cut short: loaded as it is */
+    fp = fopen(TEST_GZ, "wb");
+    fwrite(gz, 1, gzlen / 2, fp);
+    fclose(fp);
+    LoadedFile file;
+    ASSERT_EQ(loader_open(TEST_GZ, &file), 0);
+    ASSERT_EQ(file.compressed, 0);
+    ASSERT_EQ(file.size, gzlen / 2);
+    loader_close(&file);
+
+    free(twice);
+    free(gz);
+    free(text);
+    remove(TEST_GZ);
+}
+
+/* A BGZF block of the 'len' bytes at 'data' into 'out' (room for
+ * compressBound(len) + 26). Returns its size. */
+static size_t bgzf_block(const char *data, size_t len, unsigned char *out) {
+    static const unsigned char header[18] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+    };
+    memcpy(out, header, sizeof(header));
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out + 18;
+    zs.avail_out = (uInt)compressBound((uLong)len) + 8;
+    deflate(&zs, Z_FINISH);
+    size_t size = 18 + zs.total_out + 8;
+    deflateEnd(&zs);
+
+    uint32_t crc = (uint32_t)crc32(0, (const Bytef *)data, (uInt)len);
+    for (int i = 0; i < 4; i++) {
+        out[size - 8 + i] = (unsigned char)(crc >> (8 * i));
+        out[size - 4 + i] = (unsigned char)(len >> (8 * i));
+    }
+    out[16] = (unsigned char)((size - 1) & 0xff);
+    out[17] = (unsigned char)((size - 1) >> 8);
+    return size;
+}
+
+TEST(compress_loads_bgzf_blocks) {
+    size_t len;
+    char *text = make_text(50000, &len);
+
+    /* Blocks of up to 60000 bytes, and the empty block that ends a file */
+    FILE *fp = fopen(TEST_GZ, "wb");
+    unsigned char *block = malloc(compressBound(60000) + 26);
+    int blocks = 0;
+    for (size_t at = 0; at < len; at += 60000) {
+        size_t n = len - at < 60000 ? len - at : 60000;
+        fwrite(block, 1, bgzf_block(text + at, n, block), fp);
+        blocks++;
+    }
+    fwrite(block, 1, bgzf_block(text, 0, block), fp);
+    fclose(fp);
+    ASSERT_TRUE(blocks > COMPRESS_PARALLEL_MIN_PARTS);
+    ASSERT_TRUE(loads_as(TEST_GZ, text, len));
+
+    /* A block damaged: loaded as it is */
+    fp = fopen(TEST_GZ, "r+b");
+    fseek(fp, 100, SEEK_SET);
+    fputc(0, fp);
+    fputc(0, fp);
+    fclose(fp);
+    LoadedFile file;
+    ASSERT_EQ(loader_open(TEST_GZ, &file), 0);
+    ASSERT_EQ(file.compressed, 0);
+    loader_close(&file);
+
+    free(block);
+    free(text);
+    remove(TEST_GZ);
+}
+
+TEST(compress_saves_gzip_by_name) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "first", 5);
+    editor_insert_row(&ctx, 1, "second", 6);
+    long long n = save_model(&ctx.model, TEST_GZ, NULL, NULL);
+    ASSERT_TRUE(n > 0);
+    ASSERT_TRUE(loads_as(TEST_GZ, "first\nsecond\n", 13));
+    editor_ctx_free(&ctx);
+
+    editor_ctx_t opened;
+    editor_ctx_init(&opened);
+    ASSERT_EQ(editor_open(&opened, TEST_GZ), 0);
+    ASSERT_EQ(opened.model.numrows, 2);
+    ASSERT_STR_EQ(opened.model.row[1].chars, "second");
+    editor_ctx_free(&opened);
+    remove(TEST_GZ);
+}
+#else
+TEST(compress_refuses_gzip_names_without_zlib) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "first", 5);
+    ASSERT_EQ(save_model(&ctx.model, TEST_GZ, NULL, NULL), -1);
+    editor_ctx_free(&ctx);
+}
+#endif
+
+#ifdef LOKI_HAVE_ZSTD
+TEST(compress_round_trips_zstd) {
+    size_t len;
+    char *text = make_text(20000, &len);
+    ASSERT_EQ(write_compressed(TEST_ZST, COMPRESS_ZSTD, text, len), 0);
+    ASSERT_TRUE(loads_as(TEST_ZST, text, len));
+    free(text);
+    remove(TEST_ZST);
+}
+#endif
+
+BEGIN_TEST_SUITE("Compressed Files")
+    RUN_TEST(compress_tells_formats);
+#ifdef LOKI_HAVE_ZLIB
+    RUN_TEST(compress_loads_gzip_members);
+    RUN_TEST(compress_loads_bgzf_blocks);
+    RUN_TEST(compress_saves_gzip_by_name);
+#else
+    RUN_TEST(compress_refuses_gzip_names_without_zlib);
+#endif
+#ifdef LOKI_HAVE_ZSTD
+    RUN_TEST(compress_round_trips_zstd);
+#endif
+END_TEST_SUITE()
@@ -2,10 +2,12 @@
  *
  * Tests for:
  * - Editor context initialization
+ * - Row layout
  * - Row insertion and deletion
  * - Character insertion and deletion
  * - Cursor movement
  * - Separator detection
+ * - Line, word and byte counts kept through edits
  */
 
 #include "test_framework.h"
@@ -13,7 +15,9 @@
 #include "internal.h"
 #include "syntax.h"
 #include "terminal.h"
+#include "lang_bridge.h"
 #include <string.h>
+#include <stddef.h>
 
 /* Test editor context initialization */
 TEST(editor_ctx_init_initializes_all_fields) {
@@ -30,6 +34,12 @@ TEST(editor_ctx_init_initializes_all_fields) {
     /* Note: winsize_changed now lives in TerminalHost, tested separately */
 }
 
+/* The fields each redraw and highlight reads share a cache line */
+TEST(row_hot_fields_fit_one_cache_line) {
+    ASSERT_TRUE(offsetof(t_erow, damage_gen) + sizeof(unsigned long) <= 64);
+    ASSERT_TRUE(sizeof(t_erow) <= 96);
+}
+
 /* Test separator detection */
 TEST(is_separator_detects_whitespace) {
     char *seps = " \t,;";
@@ -67,7 +77,7 @@ TEST(editor_insert_char_adds_character_to_empty_buffer) {
     ctx.model.row[0].chars[0] = '\0';
     ctx.model.row[0].size = 0;
     ctx.model.row[0].render = NULL;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
     ctx.model.row[0].rsize = 0;
 
     editor_insert_char(&ctx, 'a');
@@ -78,8 +88,8 @@ TEST(editor_insert_char_adds_character_to_empty_buffer) {
 
     /* Cleanup */
     free(ctx.model.row[0].chars);
-    free(ctx.model.row[0].render);
-    free(ctx.model.row[0].hl);
+    if (ctx.model.row[0].render != ctx.model.row[0].chars) free(ctx.model.row[0].render);
+    free(ctx.model.row[0].hl_buf.hl);
     free(ctx.model.row);
 }
 
@@ -96,9 +106,8 @@ TEST(editor_insert_newline_splits_line) {
     ctx.model.row[0].chars = strdup("hello");
     ctx.model.row[0].size = 5;
     ctx.model.row[0].render = NULL;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
     ctx.model.row[0].rsize = 0;
-    ctx.model.row[0].idx = 0;
 
     /* Position cursor at index 2 (between 'e' and 'l') */
     ctx.view.cx = 2;
@@ -127,8 +136,8 @@ TEST(editor_insert_newline_splits_line) {
     /* Cleanup */
     for (int i = 0; i < ctx.model.numrows; i++) {
         free(ctx.model.row[i].chars);
-        free(ctx.model.row[i].render);
-        free(ctx.model.row[i].hl);
+        if (ctx.model.row[i].render != ctx.model.row[i].chars) free(ctx.model.row[i].render);
+        free(ctx.model.row[i].hl_buf.hl);
     }
     free(ctx.model.row);
 }
@@ -146,14 +155,14 @@ TEST(cursor_stays_within_bounds) {
     ctx.model.row[0].size = 3;
     ctx.model.row[0].render = strdup("abc");
     ctx.model.row[0].rsize = 3;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
 
     /* Row 1: "defg" */
     ctx.model.row[1].chars = strdup("defg");
     ctx.model.row[1].size = 4;
     ctx.model.row[1].render = strdup("defg");
     ctx.model.row[1].rsize = 4;
-    ctx.model.row[1].hl = NULL;
+    ctx.model.row[1].hl_buf.hl = NULL;
 
     ctx.view.screenrows = 10;
     ctx.view.screencols = 80;
@@ -179,8 +188,8 @@ TEST(cursor_stays_within_bounds) {
     /* Cleanup */
     for (int i = 0; i < ctx.model.numrows; i++) {
         free(ctx.model.row[i].chars);
-        free(ctx.model.row[i].render);
-        free(ctx.model.row[i].hl);
+        if (ctx.model.row[i].render != ctx.model.row[i].chars) free(ctx.model.row[i].render);
+        free(ctx.model.row[i].hl_buf.hl);
     }
     free(ctx.model.row);
 }
@@ -199,7 +208,7 @@ TEST(dirty_flag_set_on_modification) {
     ctx.model.row[0].chars[0] = '\0';
     ctx.model.row[0].size = 0;
     ctx.model.row[0].render = NULL;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
 
     editor_insert_char(&ctx, 'x');
 
@@ -207,8 +216,8 @@ TEST(dirty_flag_set_on_modification) {
 
     /* Cleanup */
     free(ctx.model.row[0].chars);
-    free(ctx.model.row[0].render);
-    free(ctx.model.row[0].hl);
+    if (ctx.model.row[0].render != ctx.model.row[0].chars) free(ctx.model.row[0].render);
+    free(ctx.model.row[0].hl_buf.hl);
     free(ctx.model.row);
 }
 
@@ -245,8 +254,172 @@ TEST(window_resize_flag_initialized) {
     ASSERT_EQ(terminal_host_resize_pending(&host), 0);
 }
 
+/* Gutter width is cached until the line count gains or loses a digit */
+TEST(gutter_width_follows_line_count_digits) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    ASSERT_EQ(editor_gutter_width(&ctx), 0);  /* Line numbers off */
+    ctx.view.line_numbers = 1;
+    ASSERT_EQ(editor_gutter_width(&ctx), 0);  /* Empty buffer */
+
+    ctx.model.numrows = 9;
+    ASSERT_EQ(editor_gutter_width(&ctx), 2);
+    ASSERT_EQ(ctx.view.gutter_lo, 1);
+    ASSERT_EQ(ctx.view.gutter_hi, 10);
+
+    ctx.model.numrows = 10;
+    ASSERT_EQ(editor_gutter_width(&ctx), 3);
+    ctx.model.numrows = 99;
+    ASSERT_EQ(editor_gutter_width(&ctx), 3);
+    ASSERT_EQ(ctx.view.gutter_lo, 10);
+    ctx.model.numrows = 12345;
+    ASSERT_EQ(editor_gutter_width(&ctx), 6);
+    ctx.model.numrows = 999;
+    ASSERT_EQ(editor_gutter_width(&ctx), 4);
+    ctx.model.numrows = 2147483647;
+    ASSERT_EQ(editor_gutter_width(&ctx), 11);
+
+    ctx.model.numrows = 0;
+}
+
+/* Rows without TABs render as their chars, with no copy of them */
+TEST(render_aliases_chars_without_tabs) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    editor_insert_row(&ctx, 0, "plain", 5);
+    editor_insert_row(&ctx, 1, "\ttab", 4);
+    ASSERT_TRUE(ctx.model.row[0].render == ctx.model.row[0].chars);
+    ASSERT_TRUE(ctx.model.row[0].arena_bufs & ROW_BUF_ALIAS);
+    ASSERT_TRUE(ctx.model.row[1].render != ctx.model.row[1].chars);
+    ASSERT_EQ(ctx.model.row[1].rsize, 10);
+
+    /* Growing chars moves render with them; a TAB gives it its own */
+    ctx.view.cy = 0;
+    ctx.view.cx = 5;
+    for (int i = 0; i < 64; i++) editor_insert_char(&ctx, 'x');
+    ASSERT_TRUE(ctx.model.row[0].render == ctx.model.row[0].chars);
+    ASSERT_EQ(ctx.model.row[0].rsize, 69);
+    editor_insert_char(&ctx, TAB);
+    ASSERT_TRUE(ctx.model.row[0].render != ctx.model.row[0].chars);
+    ASSERT_FALSE(ctx.model.row[0].arena_bufs & ROW_BUF_ALIAS);
+
+    editor_ctx_free(&ctx);
+}
+
+static int fake_lang_ready = 0;
+static int fake_lang_is_initialized(editor_ctx_t *ctx) {
+    (void)ctx;
+    return fake_lang_ready;
+}
+
+static const LokiLangOps fake_lang = {
+    .name = "fakelang",
+    .extensions = {".fake", NULL},
+    .is_initialized = fake_lang_is_initialized,
+};
+
+/* The language label is looked up once per filename */
+TEST(lang_label_is_cached_per_filename) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(loki_lang_register(&fake_lang), 0);
+
+    char name[] = "song.fake";
+    ctx.model.filename = name;
+    ASSERT_STR_EQ(editor_lang_label(&ctx), "");  /* Not initialized */
+    ASSERT_TRUE(ctx.view.lang_ops == &fake_lang);
+
+    fake_lang_ready = 1;
+    ASSERT_STR_EQ(editor_lang_label(&ctx), "FAKELANG ");
+
+    char other[] = "notes.txt";
+    ctx.model.filename = other;
+    ASSERT_STR_EQ(editor_lang_label(&ctx), "");
+    ASSERT_TRUE(ctx.view.lang_ops == NULL);
+
+    ctx.model.filename = NULL;
+    ASSERT_STR_EQ(editor_lang_label(&ctx), "");
+    fake_lang_ready = 0;
+}
+
+/* Helper: The counts of the rows, counted from scratch */
+static EditorCounts count_rows(const editor_ctx_t *ctx) {
+    EditorCounts c = {0, 0, ctx->model.numrows};
+    for (int j = 0; j < ctx->model.numrows; j++) {
+        const t_erow *row = &ctx->model.row[j];
+        c.bytes += row->size + 1;
+        for (int i = 0; i < row->size; i++) {
+            int blank = strchr(" \t\r\v\f", row->chars[i]) != NULL;
+            int prev = i > 0 && strchr(" \t\r\v\f", row->chars[i - 1]) == NULL;
+            if (!blank && !prev) c.words++;
+        }
+    }
+    return c;
+}
+
+#define ASSERT_COUNTS_KEPT(ctx) do { \
+    EditorCounts kept_ = editor_model_counts(&(ctx).model), want_ = count_rows(&(ctx)); \
+    ASSERT_EQ((int)kept_.bytes, (int)want_.bytes); \
+    ASSERT_EQ((int)kept_.words, (int)want_.words); \
+    ASSERT_EQ(kept_.lines, want_.lines); \
+} while (0)
+
+TEST(counts_follow_edits) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    EditorCounts c = editor_model_counts(&ctx.model);
+    ASSERT_EQ((int)c.bytes, 0);
+    ASSERT_EQ((int)c.words, 0);
+
+    editor_insert_row(&ctx, 0, "the quick  brown", 16);
+    editor_insert_row(&ctx, 1, "\tfox", 4);
+    editor_insert_row(&ctx, 2, "", 0);
+    c = editor_model_counts(&ctx.model);
+    ASSERT_EQ((int)c.bytes, 23);
+    ASSERT_EQ((int)c.words, 4);
+    ASSERT_EQ(c.lines, 3);
+
+    /* Joining and splitting words within a row */
+    ctx.view.cy = 0;
+    ctx.view.cx = 2;
+    editor_insert_char(&ctx, ' ');
+    ASSERT_COUNTS_KEPT(ctx);
+    ASSERT_EQ((int)editor_model_counts(&ctx.model).words, 5);
+    ctx.view.cx = 4;
+    editor_del_char(&ctx);
+    editor_del_char(&ctx);
+    ASSERT_COUNTS_KEPT(ctx);
+    ASSERT_EQ((int)editor_model_counts(&ctx.model).words, 4);
+
+    /* Rows split, joined, inserted and deleted */
+    editor_insert_newline(&ctx);
+    ASSERT_COUNTS_KEPT(ctx);
+    ctx.view.cy = 1;
+    ctx.view.cx = 0;
+    editor_del_char(&ctx);
+    ASSERT_COUNTS_KEPT(ctx);
+    editor_insert_row(&ctx, 1, "jumps over", 10);
+    editor_del_row(&ctx, 0);
+    ASSERT_COUNTS_KEPT(ctx);
+
+    /* Ranges across rows */
+    int r, col;
+    editor_replace_range(&ctx, 0, 2, 1, 2, "a b\nc\nd e f", 11, &r, &col);
+    ASSERT_COUNTS_KEPT(ctx);
+    editor_replace_range(&ctx, 0, 0, ctx.model.numrows - 1, 0, "", 0, &r, &col);
+    ASSERT_COUNTS_KEPT(ctx);
+    editor_del_rows(&ctx, 0, ctx.model.numrows);
+    ASSERT_COUNTS_KEPT(ctx);
+
+    editor_ctx_free(&ctx);
+}
+
 BEGIN_TEST_SUITE("Core Editor Functions")
     RUN_TEST(editor_ctx_init_initializes_all_fields);
+    RUN_TEST(row_hot_fields_fit_one_cache_line);
     RUN_TEST(is_separator_detects_whitespace);
     RUN_TEST(is_separator_detects_custom_separators);
     RUN_TEST(is_separator_handles_null_terminator);
@@ -256,4 +429,8 @@ BEGIN_TEST_SUITE("Core Editor Functions")
     RUN_TEST(dirty_flag_set_on_modification);
     RUN_TEST(mode_switching_works);
     RUN_TEST(window_resize_flag_initialized);
+    RUN_TEST(gutter_width_follows_line_count_digits);
+    RUN_TEST(render_aliases_chars_without_tabs);
+    RUN_TEST(lang_label_is_cached_per_filename);
+    RUN_TEST(counts_follow_edits);
 END_TEST_SUITE()
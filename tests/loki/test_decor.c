@@ -0,0 +1,222 @@
+/* test_decor.c - Unit tests for the decoration layer
+ *
+ * Tests for:
+ * - Adding decorations and reading a row's back in order
+ * - Decorations moving with inserted and deleted text and lines
+ * - Decorations cut by an edit, and dropped when emptied
+ * - Clearing a group or some rows of it, and the editor drawing
+ *   decorations over highlight
+ */
+
+#include "test_framework.h"
+#include "decor.h"
+#include "hl_spans.h"
+#include "internal.h"
+#include "syntax.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Decorations collected by collect() */
+typedef struct {
+    Decor d[16];
+    int count;
+} Collected;
+
+static void collect(void *opaque, const Decor *decor) {
+    Collected *c = opaque;
+    if (c->count < 16) c->d[c->count++] = *decor;
+}
+
+static Collected row_decor(DecorLayer *layer, int row) {
+    Collected c = { .count = 0 };
+    decor_row_each(layer, row, collect, &c);
+    return c;
+}
+
+TEST(decorations_read_back_by_row) {
+    DecorLayer *layer = decor_layer_new();
+    ASSERT_NOT_NULL(layer);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUP_LUA, 3, 10, 2, HL_STRING), 0);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUP_LUA, 3, 1, 4, HL_COMMENT), 0);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUP_SEARCH, 3, 5, 1, HL_MATCH), 0);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUP_LUA, 4, 0, 1, HL_NUMBER), 0);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUP_LUA, 2, 0, 0, HL_NUMBER), -1);
+    ASSERT_EQ(decor_add(layer, DECOR_GROUPS, 2, 0, 1, HL_NUMBER), -1);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_LUA), 3);
+
+    /* Higher groups first, each in column order */
+    Collected c = row_decor(layer, 3);
+    ASSERT_EQ(c.count, 3);
+    ASSERT_EQ(c.d[0].col, 1);
+    ASSERT_EQ(c.d[0].end, 5);
+    ASSERT_EQ(c.d[1].col, 10);
+    ASSERT_EQ(c.d[1].hl, HL_STRING);
+    ASSERT_EQ(c.d[2].group, DECOR_GROUP_SEARCH);
+    ASSERT_EQ(row_decor(layer, 0).count, 0);
+
+    decor_layer_free(layer);
+}
+
+TEST(decorations_move_with_edits) {
+    DecorLayer *layer = decor_layer_new();
+    for (int row = 0; row < 100; row++)
+        decor_add(layer, DECOR_GROUP_LUA, row, 4, 3, HL_MATCH);
+
+    /* Two chars typed before the one on row 10, one after it on row 11 */
+    decor_note_edit(layer, 10, 0, 10, 0, 10, 2);
+    decor_note_edit(layer, 11, 8, 11, 8, 11, 9);
+    ASSERT_EQ(row_decor(layer, 10).d[0].col, 6);
+    ASSERT_EQ(row_decor(layer, 10).d[0].end, 9);
+    ASSERT_EQ(row_decor(layer, 11).d[0].col, 4);
+
+    /* A line inserted at row 20 pushes the rest down */
+    decor_note_edit(layer, 20, 0, 20, 0, 21, 0);
+    ASSERT_EQ(row_decor(layer, 20).count, 0);
+    ASSERT_EQ(row_decor(layer, 21).d[0].col, 4);
+    ASSERT_EQ(row_decor(layer, 100).count, 1);
+
+    /* Rows 30-39 deleted take their decorations with them */
+    decor_note_edit(layer, 30, 0, 40, 0, 30, 0);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_LUA), 90);
+    ASSERT_EQ(row_decor(layer, 90).count, 1);
+    ASSERT_EQ(row_decor(layer, 91).count, 0);
+
+    /* A row split before a decoration carries it to the new row */
+    decor_note_edit(layer, 50, 2, 50, 2, 51, 0);
+    ASSERT_EQ(row_decor(layer, 50).count, 0);
+    ASSERT_EQ(row_decor(layer, 51).d[0].col, 2);
+    ASSERT_EQ(row_decor(layer, 52).d[0].col, 4);
+
+    decor_layer_free(layer);
+}
+
+TEST(decorations_cut_by_edits) {
+    DecorLayer *layer = decor_layer_new();
+    decor_add(layer, DECOR_GROUP_LUA, 0, 4, 6, HL_MATCH);   /* [4, 10) */
+    decor_add(layer, DECOR_GROUP_LUA, 1, 4, 2, HL_MATCH);   /* [4, 6) */
+    decor_add(layer, DECOR_GROUP_LUA, 2, 4, 6, HL_MATCH);   /* [4, 10) */
+
+    /* Deleting [2, 6) of row 0 leaves its tail, moved back */
+    decor_note_edit(layer, 0, 2, 0, 6, 0, 2);
+    Collected c = row_decor(layer, 0);
+    ASSERT_EQ(c.count, 1);
+    ASSERT_EQ(c.d[0].col, 2);
+    ASSERT_EQ(c.d[0].end, 6);
+
+    /* Deleting all of one drops it */
+    decor_note_edit(layer, 1, 3, 1, 7, 1, 3);
+    ASSERT_EQ(row_decor(layer, 1).count, 0);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_LUA), 2);
+
+    /* Replacing [6, 8) with 5 chars grows it */
+    decor_note_edit(layer, 2, 6, 2, 8, 2, 11);
+    c = row_decor(layer, 2);
+    ASSERT_EQ(c.d[0].col, 4);
+    ASSERT_EQ(c.d[0].end, 13);
+
+    /* Breaking the line inside it keeps the part before */
+    decor_note_edit(layer, 2, 6, 2, 6, 3, 0);
+    c = row_decor(layer, 2);
+    ASSERT_EQ(c.count, 1);
+    ASSERT_EQ(c.d[0].end, 6);
+
+    decor_layer_free(layer);
+}
+
+TEST(clearing_a_group_reports_its_decorations) {
+    DecorLayer *layer = decor_layer_new();
+    for (int i = 0; i < 50; i++) {
+        decor_add(layer, DECOR_GROUP_SEARCH, i, 0, 1, HL_MATCH);
+        decor_add(layer, DECOR_GROUP_LUA, i, 0, 1, HL_COMMENT);
+    }
+    Collected c = { .count = 0 };
+    decor_clear(layer, DECOR_GROUP_SEARCH, NULL, NULL);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_SEARCH), 0);
+    decor_add(layer, DECOR_GROUP_SEARCH, 7, 0, 1, HL_MATCH);
+    decor_clear(layer, DECOR_GROUP_SEARCH, collect, &c);
+    ASSERT_EQ(c.count, 1);
+    ASSERT_EQ(c.d[0].row, 7);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_LUA), 50);
+    decor_layer_free(layer);
+}
+
+TEST(clearing_rows_keeps_the_rest) {
+    DecorLayer *layer = decor_layer_new();
+    for (int i = 0; i < 50; i++) {
+        decor_add(layer, DECOR_GROUP_DIFF, i, 0, 1, HL_MATCH);
+        decor_add(layer, DECOR_GROUP_DIFF, i, 2, 1, HL_MATCH);
+    }
+    decor_note_edit(layer, 0, 0, 0, 0, 5, 0);   /* Shifted lazily */
+    Collected c = { .count = 0 };
+    decor_clear_rows(layer, DECOR_GROUP_DIFF, 20, 24, collect, &c);
+    ASSERT_EQ(c.count, 10);
+    ASSERT_EQ(c.d[0].row, 20);
+    ASSERT_EQ(c.d[9].row, 24);
+    ASSERT_EQ(decor_count(layer, DECOR_GROUP_DIFF), 90);
+    ASSERT_EQ(row_decor(layer, 19).count, 2);
+    ASSERT_EQ(row_decor(layer, 22).count, 0);
+    ASSERT_EQ(row_decor(layer, 25).count, 2);
+    ASSERT_EQ(row_decor(layer, 54).count, 2);
+    decor_layer_free(layer);
+}
+
+TEST(hl_spans_overlay_splits_runs) {
+    HlSpans spans;
+    hl_spans_init(&spans);
+    hl_spans_push(&spans, 0, 10, HL_NORMAL);
+    hl_spans_push(&spans, 10, 10, HL_COMMENT);
+    hl_spans_overlay(&spans, 8, 4, HL_MATCH);
+    ASSERT_EQ(spans.count, 3);
+    ASSERT_EQ(spans.span[0].len, 8);
+    ASSERT_EQ(spans.span[1].start, 8);
+    ASSERT_EQ(spans.span[1].hl, HL_MATCH);
+    ASSERT_EQ(spans.span[2].start, 12);
+    ASSERT_EQ(spans.span[2].len, 8);
+    hl_spans_free(&spans);
+}
+
+TEST(editor_draws_decorations_over_highlight) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+    editor_insert_row(&ctx, 0, "int x = 42;", 11);
+    t_erow *row = syntax_fresh_row(&ctx, 0);
+
+    ASSERT_EQ(editor_decorate(&ctx.model, DECOR_GROUP_LUA, 0, 4, 1, HL_MATCH), 0);
+    RenderSegment *segs = NULL;
+    int cap = 0;
+    int n = editor_row_segments(&ctx, row, 0, 0, 80, &segs, &cap);
+    ASSERT_TRUE(n >= 3);
+    ASSERT_EQ(segs[1].len, 1);
+    ASSERT_EQ(segs[1].hl_type, HL_TYPE_MATCH);
+    ASSERT_TRUE(segs[1].text == row->render + 4);
+    ASSERT_EQ(editor_row_hl_at(row, 4), HL_NORMAL);
+
+    /* Typing before it moves it along */
+    ctx.view.cx = 0;
+    ctx.view.cy = 0;
+    editor_insert_char(&ctx, 'u');
+    row = syntax_fresh_row(&ctx, 0);
+    n = editor_row_segments(&ctx, row, 0, 0, 80, &segs, &cap);
+    ASSERT_TRUE(n >= 3);
+    ASSERT_EQ(segs[1].hl_type, HL_TYPE_MATCH);
+    ASSERT_TRUE(segs[1].text == row->render + 5);
+
+    editor_undecorate(&ctx.model, DECOR_GROUP_LUA);
+    n = editor_row_segments(&ctx, row, 0, 0, 80, &segs, &cap);
+    for (int i = 0; i < n; i++) ASSERT_TRUE(segs[i].hl_type != HL_TYPE_MATCH);
+
+    free(segs);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Decorations")
+    RUN_TEST(decorations_read_back_by_row);
+    RUN_TEST(decorations_move_with_edits);
+    RUN_TEST(decorations_cut_by_edits);
+    RUN_TEST(clearing_a_group_reports_its_decorations);
+    RUN_TEST(clearing_rows_keeps_the_rest);
+    RUN_TEST(hl_spans_overlay_splits_runs);
+    RUN_TEST(editor_draws_decorations_over_highlight);
+END_TEST_SUITE()
@@ -0,0 +1,123 @@
+/* test_diff.c - Unit tests for the line diff
+ *
+ * Tests for:
+ * - Line hashes telling lines apart, of every length
+ * - Hunks for changed, inserted and deleted lines
+ * - Equal texts, empty texts, and texts with nothing in common
+ * - The hunks turning the old lines into the new ones
+ */
+
+#include "test_framework.h"
+#include "diff.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Hash each line of 'lines' (one char per line) */
+static int hash_lines(const char *lines, uint64_t *out) {
+    int n = (int)strlen(lines);
+    for (int i = 0; i < n; i++) out[i] = diff_hash(lines + i, 1);
+    return n;
+}
+
+/* Apply the hunks of old -> new to 'old' and compare with 'new' */
+static int patch_matches(const char *old, const char *new_, const DiffHunk *h,
+                         int nh) {
+    char out[256];
+    int len = 0, at = 0;
+    for (int i = 0; i < nh; i++) {
+        while (at < h[i].old_start) out[len++] = old[at++];
+        for (int j = 0; j < h[i].new_count; j++) out[len++] = new_[h[i].new_start + j];
+        at += h[i].old_count;
+    }
+    while (old[at]) out[len++] = old[at++];
+    out[len] = '\0';
+    return strcmp(out, new_) == 0;
+}
+
+static int diff(const char *old, const char *new_, DiffHunk **h, int *nh) {
+    uint64_t a[128], b[128];
+    int na = hash_lines(old, a), nb = hash_lines(new_, b);
+    return diff_lines(a, na, b, nb, h, nh);
+}
+
+TEST(hash_tells_lines_apart) {
+    const char *s = "the quick brown fox jumps over the lazy dog";
+    size_t len = strlen(s);
+    for (size_t n = 0; n < len; n++) {
+        ASSERT_TRUE(diff_hash(s, n) != diff_hash(s, n + 1));
+        ASSERT_EQ(diff_hash(s, n) == diff_hash(s + 1, n), n == 0);
+    }
+    ASSERT_TRUE(diff_hash("abcdefgh", 8) != diff_hash("abcdefgi", 8));
+}
+
+TEST(diff_finds_changes) {
+    DiffHunk *h;
+    int nh;
+
+    ASSERT_EQ(diff("abcdef", "abcdef", &h, &nh), 0);
+    ASSERT_EQ(nh, 0);
+    free(h);
+
+    /* One line changed */
+    ASSERT_EQ(diff("abcdef", "abXdef", &h, &nh), 0);
+    ASSERT_EQ(nh, 1);
+    ASSERT_EQ(h[0].old_start, 2);
+    ASSERT_EQ(h[0].old_count, 1);
+    ASSERT_EQ(h[0].new_start, 2);
+    ASSERT_EQ(h[0].new_count, 1);
+    free(h);
+
+    /* Inserted at the top, deleted in the middle */
+    ASSERT_EQ(diff("abcdef", "Xabcef", &h, &nh), 0);
+    ASSERT_EQ(nh, 2);
+    ASSERT_EQ(h[0].old_start, 0);
+    ASSERT_EQ(h[0].old_count, 0);
+    ASSERT_EQ(h[0].new_count, 1);
+    ASSERT_EQ(h[1].old_start, 3);
+    ASSERT_EQ(h[1].old_count, 1);
+    ASSERT_EQ(h[1].new_count, 0);
+    ASSERT_TRUE(patch_matches("abcdef", "Xabcef", h, nh));
+    free(h);
+
+    /* From and to nothing */
+    ASSERT_EQ(diff("", "abc", &h, &nh), 0);
+    ASSERT_EQ(nh, 1);
+    ASSERT_EQ(h[0].new_count, 3);
+    free(h);
+    ASSERT_EQ(diff("abc", "", &h, &nh), 0);
+    ASSERT_EQ(nh, 1);
+    ASSERT_EQ(h[0].old_count, 3);
+    free(h);
+}
+
+TEST(diff_hunks_patch_old_into_new) {
+    const char *pairs[][2] = {
+        { "abcabba", "cbabac" },            /* Myers' example */
+        { "abcdefghij", "axcyefzhij" },
+        { "aaaaaaa", "aaabaaa" },
+        { "abcdefg", "gfedcba" },
+        { "xyz", "abc" },
+        { "abab", "baba" },
+    };
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        DiffHunk *h;
+        int nh;
+        ASSERT_EQ(diff(pairs[i][0], pairs[i][1], &h, &nh), 0);
+        ASSERT_TRUE(patch_matches(pairs[i][0], pairs[i][1], h, nh));
+        free(h);
+    }
+
+    /* Myers' example takes five edits */
+    DiffHunk *h;
+    int nh, edits = 0;
+    diff("abcabba", "cbabac", &h, &nh);
+    for (int i = 0; i < nh; i++) edits += h[i].old_count + h[i].new_count;
+    ASSERT_EQ(edits, 5);
+    free(h);
+}
+
+BEGIN_TEST_SUITE("Diff")
+    RUN_TEST(hash_tells_lines_apart);
+    RUN_TEST(diff_finds_changes);
+    RUN_TEST(diff_hunks_patch_old_into_new);
+END_TEST_SUITE()
@@ -0,0 +1,204 @@
+/* test_diffview.c - Unit tests for :diff between buffers
+ *
+ * Tests for:
+ * - The histogram diff: hunks that patch the old lines into the new,
+ *   anchored on unique lines, and mapping lines across
+ * - Decorations on both sides for deleted, added and changed lines
+ * - Edits to either side diffed again, the hunks still patching one
+ *   into the other
+ * - The other side's view kept in step, hunk steps, and ending the diff
+ */
+
+#include "test_framework.h"
+#include "diffview.h"
+#include "decor.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void fill(editor_ctx_t *ctx, const char **lines, int n) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 4;
+    ctx->view.screencols = 80;
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+    ctx->model.dirty = 0;
+}
+
+/* Do the hunks turn the rows of 'old' into those of 'new'? */
+static int hunks_patch(editor_ctx_t *old, editor_ctx_t *new_) {
+    const DiffHunk *h;
+    int nh = diffview_hunks(&new_->model, &h);
+    if (nh < 0) return 0;
+    int at = 0, out = 0;
+    for (int i = 0; i < nh; i++) {
+        if (h[i].old_start < at || h[i].new_start != out + (h[i].old_start - at))
+            return 0;
+        for (; at < h[i].old_start; at++, out++)
+            if (strcmp(old->model.row[at].chars, new_->model.row[out].chars) != 0)
+                return 0;
+        at += h[i].old_count;
+        out += h[i].new_count;
+    }
+    for (; at < old->model.numrows; at++, out++)
+        if (out >= new_->model.numrows ||
+            strcmp(old->model.row[at].chars, new_->model.row[out].chars) != 0)
+            return 0;
+    return out == new_->model.numrows;
+}
+
+/* The style of the diff decoration on a row, or -1 */
+static int diff_style;
+static void take_style(void *opaque, const Decor *d) {
+    (void)opaque;
+    if (d->group == DECOR_GROUP_DIFF) diff_style = d->hl;
+}
+static int style_of(editor_ctx_t *ctx, int row) {
+    diff_style = -1;
+    if (ctx->model.decor) decor_row_each(ctx->model.decor, row, take_style, NULL);
+    return diff_style;
+}
+
+TEST(histogram_diff_anchors_on_unique_lines) {
+    /* The braces are common; the names anchor the diff */
+    const char *old_text[] = { "int f() {", "}", "int g() {", "}" };
+    const char *new_text[] = { "int g() {", "}", "int h() {", "}" };
+    uint64_t a[4], b[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = diff_hash(old_text[i], strlen(old_text[i]));
+        b[i] = diff_hash(new_text[i], strlen(new_text[i]));
+    }
+    DiffHunk *h;
+    int nh;
+    ASSERT_EQ(diff_histogram(a, 4, b, 4, &h, &nh), 0);
+    ASSERT_EQ(nh, 2);
+    ASSERT_EQ(h[0].old_start, 0);
+    ASSERT_EQ(h[0].old_count, 2);
+    ASSERT_EQ(h[0].new_count, 0);
+    ASSERT_EQ(h[1].old_start, 4);
+    ASSERT_EQ(h[1].new_start, 2);
+    ASSERT_EQ(h[1].new_count, 2);
+
+    /* Old line 2 is new line 0, and back */
+    ASSERT_EQ(diff_map_line(h, nh, 2, 0), 0);
+    ASSERT_EQ(diff_map_line(h, nh, 0, 1), 2);
+    ASSERT_EQ(diff_map_line(h, nh, 3, 0), 1);
+    free(h);
+}
+
+TEST(diff_decorates_both_sides) {
+    const char *old_lines[] = { "alpha", "beta", "gamma", "delta", "epsilon" };
+    const char *new_lines[] = { "alpha", "BETA", "gamma", "epsilon", "zeta" };
+    editor_ctx_t old, new_;
+    fill(&old, old_lines, 5);
+    fill(&new_, new_lines, 5);
+
+    ASSERT_EQ(diffview_start(&old, &new_), 0);
+    ASSERT_TRUE(hunks_patch(&old, &new_));
+    ASSERT_EQ(style_of(&old, 0), -1);
+    ASSERT_EQ(style_of(&old, 1), DIFFVIEW_HL_CHANGED);
+    ASSERT_EQ(style_of(&new_, 1), DIFFVIEW_HL_CHANGED);
+    ASSERT_EQ(style_of(&old, 3), DIFFVIEW_HL_DELETED);
+    ASSERT_EQ(style_of(&new_, 3), -1);
+    ASSERT_EQ(style_of(&new_, 4), DIFFVIEW_HL_ADDED);
+
+    /* One diff at a time, and not with itself */
+    ASSERT_EQ(diffview_start(&new_, &old), -1);
+
+    diffview_stop(&old.model);
+    ASSERT_NULL(old.model.diff);
+    ASSERT_NULL(new_.model.diff);
+    ASSERT_EQ(decor_count(old.model.decor, DECOR_GROUP_DIFF), 0);
+    ASSERT_EQ(decor_count(new_.model.decor, DECOR_GROUP_DIFF), 0);
+    ASSERT_EQ(diffview_start(&old, &old), -1);
+
+    editor_ctx_free(&old);
+    editor_ctx_free(&new_);
+}
+
+TEST(edits_are_diffed_again) {
+    const char *lines[] = { "a", "b", "c", "d", "e", "f", "g", "h", "i", "j" };
+    editor_ctx_t old, new_;
+    fill(&old, lines, 10);
+    fill(&new_, lines, 10);
+    ASSERT_EQ(diffview_start(&old, &new_), 0);
+    const DiffHunk *h;
+    ASSERT_EQ(diffview_hunks(&new_.model, &h), 0);
+
+    /* A line changed in the middle */
+    editor_cursor_to(&new_, 4, 0);
+    editor_insert_char(&new_, 'x');
+    diffview_tick(&new_);
+    ASSERT_EQ(diffview_hunks(&new_.model, &h), 1);
+    ASSERT_EQ(h[0].old_start, 4);
+    ASSERT_EQ(h[0].new_start, 4);
+    ASSERT_EQ(style_of(&new_, 4), DIFFVIEW_HL_CHANGED);
+    ASSERT_TRUE(hunks_patch(&old, &new_));
+
+    /* Lines added above it move it down */
+    editor_cursor_to(&new_, 1, 0);
+    editor_insert_newline(&new_);
+    editor_insert_char(&new_, 'y');
+    diffview_tick(&new_);
+    ASSERT_TRUE(hunks_patch(&old, &new_));
+    ASSERT_EQ(diffview_hunks(&new_.model, &h), 2);
+    ASSERT_EQ(h[1].new_start, 5);
+    ASSERT_EQ(style_of(&new_, 5), DIFFVIEW_HL_CHANGED);
+
+    /* The old side edited to match: that hunk goes */
+    editor_cursor_to(&old, 4, 0);
+    editor_insert_char(&old, 'x');
+    diffview_tick(&old);
+    ASSERT_TRUE(hunks_patch(&old, &new_));
+    ASSERT_EQ(diffview_hunks(&new_.model, &h), 1);
+    ASSERT_EQ(style_of(&old, 4), -1);
+    ASSERT_EQ(style_of(&new_, 5), -1);
+
+    /* Rows deleted at the end */
+    editor_del_row(&new_, new_.model.numrows - 1);
+    editor_del_row(&new_, new_.model.numrows - 1);
+    diffview_tick(&new_);
+    ASSERT_TRUE(hunks_patch(&old, &new_));
+    ASSERT_EQ(diffview_hunks(&new_.model, &h), 2);
+    ASSERT_EQ(style_of(&old, 9), DIFFVIEW_HL_DELETED);
+
+    diffview_stop(&new_.model);
+    editor_ctx_free(&old);
+    editor_ctx_free(&new_);
+}
+
+TEST(other_view_kept_in_step) {
+    const char *old_lines[] = { "1", "2", "3", "4", "5", "6", "7", "8" };
+    const char *new_lines[] = { "0", "0", "0", "1", "2", "3", "4", "5", "6", "7", "8" };
+    editor_ctx_t old, new_;
+    fill(&old, old_lines, 8);
+    fill(&new_, new_lines, 11);
+    ASSERT_EQ(diffview_start(&old, &new_), 0);
+
+    editor_cursor_to(&new_, 9, 0);
+    diffview_tick(&new_);
+    ASSERT_EQ(old.view.rowoff + old.view.cy, 6);
+    ASSERT_TRUE(old.view.cy < old.view.screenrows);
+
+    editor_cursor_to(&old, 0, 0);
+    diffview_tick(&old);
+    ASSERT_EQ(new_.view.rowoff + new_.view.cy, 3);
+
+    /* Hunk to hunk */
+    editor_cursor_to(&new_, 5, 0);
+    ASSERT_EQ(diffview_jump(&new_, -1), 0);
+    ASSERT_EQ(new_.view.rowoff + new_.view.cy, 0);
+    ASSERT_EQ(diffview_jump(&new_, -1), -1);
+    ASSERT_EQ(diffview_jump(&new_, 1), -1);
+
+    editor_ctx_free(&old);      /* Ends the diff */
+    ASSERT_NULL(new_.model.diff);
+    editor_ctx_free(&new_);
+}
+
+BEGIN_TEST_SUITE("diffview")
+    RUN_TEST(histogram_diff_anchors_on_unique_lines);
+    RUN_TEST(diff_decorates_both_sides);
+    RUN_TEST(edits_are_diffed_again);
+    RUN_TEST(other_view_kept_in_step);
+END_TEST_SUITE()
@@ -0,0 +1,104 @@
+/* test_event_loop.c - Unit tests for the main-thread event loop wait
+ *
+ * Tests for:
+ * - Input readiness on a watched fd
+ * - Deadlines and zero-timeout checks
+ * - Wakeup by async events pushed from another thread
+ * - SIGWINCH delivered through the loop
+ */
+
+#include "test_framework.h"
+#include "event_loop.h"
+#include "async_queue.h"
+#include "terminal.h"
+#include <signal.h>
+#include <unistd.h>
+#include <uv.h>
+
+static int fds[2];
+
+static void setup(void) {
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(async_queue_init(), 0);
+    ASSERT_EQ(event_loop_init(fds[0]), 0);
+    ASSERT_TRUE(event_loop_active());
+}
+
+static void teardown(void) {
+    event_loop_cleanup();
+    async_queue_cleanup();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(wait_reports_readable_input) {
+    setup();
+    ASSERT_FALSE(event_loop_wait(0) & EVENT_LOOP_INPUT);
+
+    ASSERT_EQ(write(fds[1], "x", 1), 1);
+    ASSERT_TRUE(event_loop_wait(-1) & EVENT_LOOP_INPUT);
+
+    char c;
+    ASSERT_EQ(read(fds[0], &c, 1), 1);
+    ASSERT_FALSE(event_loop_wait(0) & EVENT_LOOP_INPUT);
+    teardown();
+}
+
+TEST(wait_honours_deadline) {
+    setup();
+    uint64_t start = uv_hrtime();
+    int got = event_loop_wait(20);
+    uint64_t waited = (uv_hrtime() - start) / 1000000;
+    ASSERT_TRUE(got & EVENT_LOOP_TIMEOUT);
+    ASSERT_FALSE(got & EVENT_LOOP_INPUT);
+    ASSERT_TRUE(waited >= 15);
+    teardown();
+}
+
+static void push_later(void *arg) {
+    (void)arg;
+    usleep(20000);
+    async_queue_push_custom(NULL, "wake", NULL, 0);
+}
+
+TEST(async_push_wakes_wait) {
+    setup();
+    uv_thread_t thread;
+    ASSERT_EQ(uv_thread_create(&thread, push_later, NULL), 0);
+
+    /* No deadline: only the push can end this wait */
+    int got = 0;
+    while (!(got & EVENT_LOOP_ASYNC)) got = event_loop_wait(-1);
+    uv_thread_join(&thread);
+
+    ASSERT_FALSE(got & EVENT_LOOP_TIMEOUT);
+    ASSERT_EQ(async_queue_count(NULL), 1);
+    teardown();
+}
+
+TEST(sigwinch_is_delivered_through_loop) {
+    TerminalHost host;
+    terminal_host_init(&host, fds[0]);  /* Before the loop, like the editor */
+    setup();
+
+    raise(SIGWINCH);
+    int got = 0;
+    while (!(got & EVENT_LOOP_RESIZE)) got = event_loop_wait(-1);
+    ASSERT_TRUE(terminal_host_resize_pending(&host));
+
+    teardown();
+    terminal_host_cleanup(&host);
+}
+
+TEST(inactive_loop_returns_nothing) {
+    ASSERT_FALSE(event_loop_active());
+    ASSERT_EQ(event_loop_wait(10), 0);
+}
+
+BEGIN_TEST_SUITE("Event Loop")
+    RUN_TEST(wait_reports_readable_input);
+    RUN_TEST(wait_honours_deadline);
+    RUN_TEST(async_push_wakes_wait);
+    RUN_TEST(sigwinch_is_delivered_through_loop);
+    RUN_TEST(inactive_loop_returns_nothing);
+END_TEST_SUITE()
@@ -8,12 +8,24 @@
  * - Large file handling
  */
 
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
+#include "syntax.h"
+#include "save.h"
+#include "async_queue.h"
+#include "lazy.h"
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+
+/* Row editing function from core.c (declared locally, as in undo.c) */
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
 
 #define TEST_FILE_DIR "/tmp/loki_test"
 
@@ -58,6 +70,14 @@ static char *read_test_file(const char *filename) {
     return content;
 }
 
+/* Helper: Whether row 'r' reads its contents from the mapped file */
+static int row_in_map(const editor_ctx_t *ctx, int r) {
+    const RowMap *map = ctx->model.row_map;
+    const char *chars = ctx->model.row[r].chars;
+    return map && chars >= (const char *)map->base &&
+           chars < (const char *)map->base + map->len;
+}
+
 /* Test loading a simple text file */
 TEST(editor_open_loads_simple_file) {
     setup_test_dir();
@@ -108,7 +128,7 @@ TEST(editor_open_handles_crlf) {
 }
 
 /* Test binary file detection */
-TEST(editor_open_rejects_binary_file) {
+TEST(editor_open_shows_binary_file_in_hex) {
     setup_test_dir();
 
     /* Create binary file with null bytes */
@@ -126,9 +146,12 @@ TEST(editor_open_rejects_binary_file) {
 
     int result = editor_open(&ctx, path);
 
-    /* Should reject binary file */
-    ASSERT_NEQ(result, 0);
-    ASSERT_EQ(ctx.model.numrows, 0);
+    /* Shown in hex, a row per 16 bytes */
+    ASSERT_EQ(result, 0);
+    ASSERT_TRUE(lazy_is_hex(&ctx.model));
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_TRUE(strncmp(ctx.model.row[0].chars, "00000000: 00 01 02 ff fe ", 25) == 0);
+    ASSERT_STR_EQ(ctx.model.row[0].chars + ctx.model.row[0].size - 7, "  .....");
 
     /* Cleanup */
     editor_ctx_free(&ctx);
@@ -169,11 +192,9 @@ TEST(editor_save_writes_content) {
 
     ctx.model.row[0].chars = strdup("First line");
     ctx.model.row[0].size = 10;
-    ctx.model.row[0].idx = 0;
 
     ctx.model.row[1].chars = strdup("Second line");
     ctx.model.row[1].size = 11;
-    ctx.model.row[1].idx = 1;
 
     char path[256];
     snprintf(path, sizeof(path), "%s/output.txt", TEST_FILE_DIR);
@@ -221,6 +242,75 @@ TEST(editor_open_handles_no_trailing_newline) {
     cleanup_test_files();
 }
 
+/* Test that rows use the lines of the mapped file where they are, and get
+ * a copy of their own when first changed */
+TEST(editor_open_rows_use_the_mapped_file) {
+    setup_test_dir();
+    create_test_file("mapped.txt", "alpha\nbeta\r\ngamma");
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/mapped.txt", TEST_FILE_DIR);
+
+    ASSERT_EQ(editor_open(&ctx, path), 0);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_NOT_NULL(ctx.model.row_map);
+    for (int i = 0; i < 3; i++) ASSERT_TRUE(row_in_map(&ctx, i));
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "beta");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "gamma");
+
+    editor_row_insert_char(&ctx, &ctx.model.row[1], 0, 'x');
+    ASSERT_FALSE(row_in_map(&ctx, 1));
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "xbeta");
+    ASSERT_TRUE(row_in_map(&ctx, 0));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "alpha");
+
+    /* The rows no longer follow the file */
+    create_test_file("mapped.txt", "");
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "alpha");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "gamma");
+
+    /* A share of a row holds the mapping past the rows */
+    RowShare *share = editor_row_share(&ctx.model, &ctx.model.row[2]);
+    ASSERT_TRUE(row_in_map(&ctx, 2));
+    editor_model_free_rows(&ctx.model);
+    ASSERT_STR_EQ(share->chars, "gamma");
+    editor_row_share_release(share);
+
+    editor_ctx_free(&ctx);
+    cleanup_test_files();
+}
+
+/* Test that the last line of a file ending on a page boundary, with no
+ * room after it for a NUL, is copied */
+TEST(editor_open_copies_last_line_at_page_end) {
+    setup_test_dir();
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/page.txt", TEST_FILE_DIR);
+    long page = sysconf(_SC_PAGESIZE);
+    FILE *f = fopen(path, "w");
+    ASSERT_NOT_NULL(f);
+    fputs("x\n", f);
+    for (long i = 2; i < page; i++) fputc('b', f);
+    fclose(f);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    ASSERT_EQ(editor_open(&ctx, path), 0);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_TRUE(row_in_map(&ctx, 0));
+    ASSERT_FALSE(row_in_map(&ctx, 1));
+    ASSERT_EQ(ctx.model.row[1].size, (int)page - 2);
+    ASSERT_EQ(ctx.model.row[1].chars[page - 2], '\0');
+
+    editor_ctx_free(&ctx);
+    cleanup_test_files();
+}
+
 /* Test loading nonexistent file */
 TEST(editor_open_handles_nonexistent_file) {
     editor_ctx_t ctx;
@@ -266,13 +356,207 @@ TEST(editor_open_handles_long_lines) {
     cleanup_test_files();
 }
 
+/* Test that large files opened on worker threads keep multi-line comment
+ * highlighting consistent across the chunks the threads work on */
+TEST(editor_open_large_file_highlights_across_chunks) {
+    setup_test_dir();
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/large.c", TEST_FILE_DIR);
+    FILE *f = fopen(path, "w");
+    ASSERT_NOT_NULL(f);
+    for (int i = 0; i < 40000; i++) {
+        if (i == 4094) fputs("int x; /* comment opens\n", f);
+        else if (i == 4100) fputs("   comment closes */ int y;\n", f);
+        else fprintf(f, "\tint line_%d = %d;\n", i, i);
+    }
+    fclose(f);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    syntax_select_for_filename(&ctx, path);
+
+    ASSERT_EQ(editor_open(&ctx, path), 0);
+    ASSERT_EQ(ctx.model.numrows, 40000);
+    ASSERT_STR_EQ(ctx.model.row[39999].chars, "\tint line_39999 = 39999;");
+    ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[39999]), 39999);
+    ASSERT_EQ(ctx.model.row[1].render[0], ' ');
+    ASSERT_TRUE(ctx.model.row[1].rsize > ctx.model.row[1].size);
+    ASSERT_TRUE(row_in_map(&ctx, 1));
+
+    /* Rows 4095..4099 straddle the first chunk boundary and are inside
+     * the comment; the row after it closes is back to normal. */
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 4096), 7), HL_MLCOMMENT);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 4099), 7), HL_MLCOMMENT);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 4101), 7), HL_KEYWORD2);
+    ASSERT_EQ(ctx.model.row[4101].hl_oc, 0);
+    ASSERT_EQ(ctx.model.dirty, 0);
+
+    editor_ctx_free(&ctx);
+    cleanup_test_files();
+}
+
+/* Count directory entries whose name starts with 'prefix'. */
+static int count_files_with_prefix(const char *prefix) {
+    DIR *dir = opendir(TEST_FILE_DIR);
+    if (!dir) return -1;
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/* Test that saving replaces the file in one step and keeps its mode */
+TEST(editor_save_replaces_file_atomically) {
+    setup_test_dir();
+    create_test_file("atomic.txt", "old content that is longer than the new\n");
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/atomic.txt", TEST_FILE_DIR);
+    chmod(path, 0600);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "new", 3);
+    editor_insert_row(&ctx, 1, "", 0);
+    ctx.model.filename = strdup(path);
+
+    ASSERT_EQ(editor_save(&ctx), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "5 bytes written on disk");
+
+    char *content = read_test_file("atomic.txt");
+    ASSERT_NOT_NULL(content);
+    ASSERT_STR_EQ(content, "new\n\n");
+    free(content);
+
+    struct stat st;
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ(st.st_mode & 0777, 0600);
+
+    /* No temporary file is left behind */
+    ASSERT_EQ(count_files_with_prefix("atomic.txt"), 1);
+
+    editor_ctx_free(&ctx);
+    cleanup_test_files();
+}
+
+/* Test that saving through a symlink updates the target, not the link */
+TEST(editor_save_follows_symlink) {
+    setup_test_dir();
+    create_test_file("real.txt", "old\n");
+
+    char real[256], link[256];
+    snprintf(real, sizeof(real), "%s/real.txt", TEST_FILE_DIR);
+    snprintf(link, sizeof(link), "%s/link.txt", TEST_FILE_DIR);
+    ASSERT_EQ(symlink(real, link), 0);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "via link", 8);
+    ctx.model.filename = strdup(link);
+
+    ASSERT_EQ(editor_save(&ctx), 0);
+
+    struct stat st;
+    ASSERT_EQ(lstat(link, &st), 0);
+    ASSERT_TRUE(S_ISLNK(st.st_mode));
+
+    char *content = read_test_file("real.txt");
+    ASSERT_NOT_NULL(content);
+    ASSERT_STR_EQ(content, "via link\n");
+    free(content);
+
+    editor_ctx_free(&ctx);
+    cleanup_test_files();
+}
+
+/* Test a background save, with an edit waiting for it to finish */
+TEST(editor_save_async_completes_before_edit) {
+    setup_test_dir();
+    ASSERT_EQ(async_queue_init(), 0);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/async.txt", TEST_FILE_DIR);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < 1000; i++) {
+        char line[32];
+        int len = snprintf(line, sizeof(line), "line %d", i);
+        editor_insert_row(&ctx, i, line, len);
+    }
+    ctx.model.filename = strdup(path);
+
+    ASSERT_EQ(editor_save_async(&ctx), 0);
+    ASSERT_NOT_NULL(ctx.model.save_job);
+
+    /* Editing waits for the save, so the file has the old content */
+    editor_row_insert_char(&ctx, &ctx.model.row[0], 0, 'X');
+    ASSERT_NULL(ctx.model.save_job);
+    ASSERT_EQ(ctx.model.dirty, 1);
+
+    char *content = read_test_file("async.txt");
+    ASSERT_NOT_NULL(content);
+    ASSERT_TRUE(strncmp(content, "line 0\nline 1\n", 14) == 0);
+    free(content);
+
+    /* The completion event of the finished job is ignored */
+    async_queue_dispatch_all(NULL, &ctx);
+    ASSERT_EQ(ctx.model.dirty, 1);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+    cleanup_test_files();
+}
+
+/* Test waiting for a save whose completion finds the event queue full */
+TEST(editor_save_wait_with_queue_full) {
+    setup_test_dir();
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    while (async_queue_push_timer(NULL, 1, NULL) == 0) {}
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/full.txt", TEST_FILE_DIR);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[] = "text";
+    editor_insert_row(&ctx, 0, line, strlen(line));
+    ctx.model.filename = strdup(path);
+
+    ASSERT_EQ(editor_save_async(&ctx), 0);
+    /* The worker is done, and waiting for room for its completion */
+    struct timespec ts = {0, 20000000};
+    nanosleep(&ts, NULL);
+    editor_save_wait(&ctx.model);
+    ASSERT_NULL(ctx.model.save_job);
+    ASSERT_EQ(ctx.model.dirty, 0);
+
+    char *content = read_test_file("full.txt");
+    ASSERT_NOT_NULL(content);
+    ASSERT_STR_EQ(content, "text\n");
+    free(content);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+    cleanup_test_files();
+}
+
 BEGIN_TEST_SUITE("File I/O Integration")
     RUN_TEST(editor_open_loads_simple_file);
     RUN_TEST(editor_open_handles_crlf);
-    RUN_TEST(editor_open_rejects_binary_file);
+    RUN_TEST(editor_open_shows_binary_file_in_hex);
     RUN_TEST(editor_open_handles_empty_file);
     RUN_TEST(editor_save_writes_content);
+    RUN_TEST(editor_save_replaces_file_atomically);
+    RUN_TEST(editor_save_follows_symlink);
+    RUN_TEST(editor_save_async_completes_before_edit);
+    RUN_TEST(editor_save_wait_with_queue_full);
     RUN_TEST(editor_open_handles_no_trailing_newline);
     RUN_TEST(editor_open_handles_nonexistent_file);
     RUN_TEST(editor_open_handles_long_lines);
+    RUN_TEST(editor_open_large_file_highlights_across_chunks);
 END_TEST_SUITE()
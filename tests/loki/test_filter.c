@@ -0,0 +1,156 @@
+/* test_filter.c - Unit tests for filtering rows through a command
+ *
+ * Tests for:
+ * - A whole buffer sorted, undone in one step
+ * - A range in the middle, and output of another length than the input
+ * - A command that fails, or is stopped, putting the rows back
+ * - Many rows streamed through, the buffer read-only meanwhile
+ */
+
+#include "test_framework.h"
+#include "filter.h"
+#include "internal.h"
+#include "undo.h"
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+static void fill(editor_ctx_t *ctx, const char **lines, int n) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 10;
+    ctx->view.screencols = 80;
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+/* Run the loop until the filter is done, for ten seconds at most */
+static void wait_filter(editor_ctx_t *ctx) {
+    uint64_t until = uv_hrtime() + (uint64_t)10 * 1000000000;
+    while (ctx->model.filter && uv_hrtime() < until) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        filter_tick();
+    }
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);   /* Close the handles */
+}
+
+TEST(filter_sorts_buffer) {
+    const char *lines[] = { "cherry", "apple", "banana" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 3);
+    undo_break_group(&ctx);
+
+    ASSERT_EQ(filter_start(&ctx, 0, 2, "sort"), 0);
+    ASSERT_NOT_NULL(ctx.model.filter);
+    wait_filter(&ctx);
+    ASSERT_NULL(ctx.model.filter);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "apple");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "banana");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "cherry");
+
+    /* One step back */
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "cherry");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "banana");
+    editor_ctx_free(&ctx);
+}
+
+TEST(filter_range_and_line_counts) {
+    const char *lines[] = { "one", "two", "three", "four" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 4);
+
+    ASSERT_EQ(filter_start(&ctx, 1, 2, "tr a-z A-Z"), 0);
+    wait_filter(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 4);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "one");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "TWO");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "THREE");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "four");
+
+    /* More lines than went in, the last without its newline */
+    ASSERT_EQ(filter_start(&ctx, 0, 1, "cat >/dev/null; printf 'p\\nq\\nr'"), 0);
+    wait_filter(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 5);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "p");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "r");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "THREE");
+
+    /* None: the end of the buffer goes */
+    ASSERT_EQ(filter_start(&ctx, 3, 4, "true"), 0);
+    wait_filter(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "r");
+
+    /* Nor of the whole buffer */
+    ASSERT_EQ(filter_start(&ctx, 0, 2, "true"), 0);
+    wait_filter(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_EQ(ctx.model.row[0].size, 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(filter_failure_puts_rows_back) {
+    const char *lines[] = { "keep", "these" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 2);
+
+    ASSERT_EQ(filter_start(&ctx, 0, 1, "cat; echo oops >&2; exit 3"), 0);
+    wait_filter(&ctx);
+    ASSERT_NULL(ctx.model.filter);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "keep");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "these");
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "exit 3") != NULL);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "oops") != NULL);
+
+    /* Stopped */
+    ASSERT_EQ(filter_start(&ctx, 0, 1, "cat; sleep 5"), 0);
+    for (int i = 0; i < 20; i++) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        filter_tick();
+    }
+    ASSERT_EQ(filter_cancel(&ctx), 0);
+    ASSERT_NULL(ctx.model.filter);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "keep");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "these");
+    ASSERT_EQ(filter_cancel(&ctx), -1);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    editor_ctx_free(&ctx);
+}
+
+TEST(filter_streams_many_rows) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 10;
+    char line[32];
+    int n = 100000;
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "%06d some text", n - 1 - i);
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+
+    ASSERT_EQ(filter_start(&ctx, 0, n - 1, "sort"), 0);
+    ASSERT_TRUE(editor_refuse_edit(&ctx));
+    ASSERT_EQ(filter_start(&ctx, 0, 1, "cat"), -1);
+    wait_filter(&ctx);
+    ASSERT_NULL(ctx.model.filter);
+    ASSERT_EQ(ctx.model.numrows, n);
+    int sorted = 1;
+    for (int i = 0; i < n && sorted; i++) {
+        snprintf(line, sizeof(line), "%06d some text", i);
+        sorted = strcmp(ctx.model.row[i].chars, line) == 0;
+    }
+    ASSERT_TRUE(sorted);
+    ASSERT_TRUE(!editor_refuse_edit(&ctx));
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("filter")
+    RUN_TEST(filter_sorts_buffer);
+    RUN_TEST(filter_range_and_line_counts);
+    RUN_TEST(filter_failure_puts_rows_back);
+    RUN_TEST(filter_streams_many_rows);
+END_TEST_SUITE()
@@ -0,0 +1,306 @@
+/* test_finder.c - Unit tests for the fuzzy file finder
+ *
+ * Tests for:
+ * - Listing the project's files by walking the tree, skipping ignored ones
+ * - Ranking: runs, parts of the path and the file name first
+ * - Queries typed on, scored from the paths the last one matched
+ * - The cached list used on reopening, brought up to date by a walk
+ * - Saved and deleted files looked at again, and many marks walking
+ * - Walks on the task pool, taken in as their events are dispatched
+ */
+
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
+#include "test_framework.h"
+#include "finder.h"
+#include "async_queue.h"
+#include "task_pool.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_finder_test"
+
+static void write_file(const char *rel, const char *content) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return;
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void make_dir(const char *rel) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    mkdir(path, 0755);
+}
+
+static void setup_tree(void) {
+    finder_close();
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    make_dir("src");
+    make_dir("src/command");
+    make_dir("tests");
+    make_dir("build");
+    make_dir(".git");
+    write_file("src/core.c", "");
+    write_file("src/command.c", "");
+    write_file("src/command/find.c", "");
+    write_file("src/finder.c", "");
+    write_file("src/finder.h", "");
+    write_file("tests/test_finder.c", "");
+    write_file("README.md", "");
+    write_file("build/finder.o", "");
+    write_file(".git/HEAD", "");
+    write_file(".gitignore", "build/\n");
+}
+
+static void cleanup_tree(void) {
+    finder_close();
+    system("rm -rf " TEST_DIR);
+}
+
+static int path_is(const FinderMatch *m, const char *path) {
+    return m->path && (size_t)m->len == strlen(path) &&
+           memcmp(m->path, path, strlen(path)) == 0;
+}
+
+/* Whether 'path' is among the first 'n' of 'm' */
+static int found(const FinderMatch *m, int n, const char *path) {
+    for (int i = 0; i < n; i++)
+        if (path_is(&m[i], path)) return 1;
+    return 0;
+}
+
+TEST(finder_walk_lists_the_files) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+    ASSERT_EQ(finder_count(), 8);   /* .gitignore too */
+
+    FinderMatch m[16];
+    int n = finder_find("", m, 16);
+    ASSERT_EQ(n, 8);
+    ASSERT_TRUE(path_is(&m[0], "README.md"));   /* Shortest first */
+    ASSERT_FALSE(found(m, n, "build/finder.o"));
+    ASSERT_FALSE(found(m, n, ".git/HEAD"));
+
+    struct stat st;
+    ASSERT_EQ(stat(TEST_DIR "/.loki/files", &st), 0);
+    ASSERT_EQ(finder_find("zzz", m, 16), 0);
+    cleanup_tree();
+}
+
+TEST(finder_ranks_the_file_name_first) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+
+    FinderMatch m[16];
+    int n = finder_find("finder", m, 16);
+    ASSERT_EQ(n, 3);
+    /* A run starting the file name, shortest path first; one starting
+     * a part of it after */
+    ASSERT_TRUE(path_is(&m[0], "src/finder.c"));
+    ASSERT_TRUE(path_is(&m[1], "src/finder.h"));
+    ASSERT_TRUE(path_is(&m[2], "tests/test_finder.c"));
+    ASSERT_TRUE(m[0].score > m[2].score);
+
+    /* Parts of the path: "c/f" is command/find.c before the rest */
+    n = finder_find("cmdf", m, 16);
+    ASSERT_TRUE(n >= 1);
+    ASSERT_TRUE(path_is(&m[0], "src/command/find.c"));
+    n = finder_find("CORE", m, 16);
+    ASSERT_EQ(n, 1);
+    ASSERT_TRUE(path_is(&m[0], "src/core.c"));
+
+    /* At most 'max', the best */
+    n = finder_find("c", m, 2);
+    ASSERT_EQ(n, 2);
+    cleanup_tree();
+}
+
+TEST(finder_query_typed_on_scores_what_matched) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+
+    FinderMatch m[16];
+    ASSERT_EQ(finder_find("f", m, 16), 4);
+    ASSERT_EQ(finder_find("fi", m, 16), 4);
+    ASSERT_EQ(finder_find("fin", m, 16), 4);
+    ASSERT_EQ(finder_find("find", m, 16), 4);
+    ASSERT_EQ(finder_find("finde", m, 16), 3);
+    /* Back, and another way */
+    ASSERT_EQ(finder_find("fi", m, 16), 4);
+    ASSERT_EQ(finder_find("re", m, 16), 5);
+    ASSERT_TRUE(path_is(&m[0], "README.md"));
+
+    /* A file added after the last query is found by the next */
+    write_file("src/findings.txt", "");
+    finder_note_file(TEST_DIR "/src/findings.txt");
+    finder_wait();
+    ASSERT_EQ(finder_find("find", m, 16), 5);
+    ASSERT_TRUE(found(m, 5, "src/findings.txt"));
+    cleanup_tree();
+}
+
+TEST(finder_reopen_uses_the_cached_list) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+    finder_close();
+
+    /* Listed as cached at once, and as the walk finds them once it is in */
+    write_file("src/later.c", "");
+    ASSERT_EQ(async_queue_init(), 0);
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    ASSERT_TRUE(finder_busy());
+    ASSERT_EQ(finder_count(), 8);
+    FinderMatch m[4];
+    ASSERT_EQ(finder_find("later", m, 4), 0);
+    finder_wait();
+    ASSERT_EQ(finder_find("later", m, 4), 1);
+    ASSERT_TRUE(path_is(&m[0], "src/later.c"));
+    cleanup_tree();
+    task_pool_shutdown();
+    async_queue_cleanup();
+}
+
+/* Waiting for a walk whose completion finds the event queue full */
+TEST(finder_wait_with_queue_full) {
+    setup_tree();
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    /* Fill the lane walks report on; events of no walk are ignored */
+    async_queue_set_handler_lane(NULL, FINDER_ASYNC_EVENT, NULL, ASYNC_LANE_LOW);
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = FINDER_ASYNC_EVENT;
+    while (async_queue_push(NULL, &ev) == 0) {}
+
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    ASSERT_TRUE(finder_busy());
+    /* The worker is done, and waiting for room for its completion */
+    struct timespec ts = {0, 20000000};
+    nanosleep(&ts, NULL);
+    finder_wait();
+    ASSERT_FALSE(finder_busy());
+    ASSERT_EQ(finder_count(), 8);
+    cleanup_tree();
+    task_pool_shutdown();
+    async_queue_cleanup();
+}
+
+TEST(finder_marks_add_and_drop_paths) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+
+    /* Written, deleted, ignored, or the same file again */
+    write_file("src/new.c", "");
+    unlink(TEST_DIR "/src/core.c");
+    write_file("build/gen.c", "");
+    finder_note_file(TEST_DIR "/src/new.c");
+    finder_note_file(TEST_DIR "/src/core.c");
+    finder_note_file(TEST_DIR "/build/gen.c");
+    finder_note_file(TEST_DIR "/src/finder.c");
+    finder_note_file("/elsewhere/file.c");
+    finder_wait();
+    ASSERT_EQ(finder_count(), 8);
+    FinderMatch m[4];
+    ASSERT_EQ(finder_find("new", m, 4), 1);
+    ASSERT_EQ(finder_find("core", m, 4), 0);
+    ASSERT_EQ(finder_find("gen", m, 4), 0);
+
+    /* A directory gone takes its files */
+    system("rm -rf " TEST_DIR "/src/command");
+    finder_note_file(TEST_DIR "/src/command");
+    finder_wait();
+    ASSERT_EQ(finder_find("command/", m, 4), 0);
+    ASSERT_EQ(finder_count(), 7);
+
+    /* Changes are cached when the finder closes */
+    finder_close();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    ASSERT_EQ(finder_count(), 7);
+    ASSERT_EQ(finder_find("new", m, 4), 1);
+    cleanup_tree();
+}
+
+TEST(finder_many_marks_walk_the_tree) {
+    setup_tree();
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+
+    make_dir("gen");
+    char rel[64];
+    for (int i = 0; i < FINDER_MARKS_WALK + 10; i++) {
+        snprintf(rel, sizeof(rel), "gen/file%d.c", i);
+        write_file(rel, "");
+        finder_note_file(TEST_DIR "/gen/x");     /* Not a file: the walk finds them */
+        snprintf(rel, sizeof(rel), TEST_DIR "/gen/file%d.c", i);
+        finder_note_file(rel);
+    }
+    ASSERT_TRUE(finder_tick(uv_hrtime()) > 0);
+    finder_wait();
+    ASSERT_EQ(finder_count(), 8 + FINDER_MARKS_WALK + 10);
+    FinderMatch m[4];
+    ASSERT_EQ(finder_find("file12.c", m, 4), 1);
+    cleanup_tree();
+}
+
+TEST(finder_large_list_is_scored_in_parts) {
+    setup_tree();
+    make_dir("many");
+    char rel[64];
+    for (int i = 0; i < FINDER_PART_PATHS + 1000; i++) {
+        snprintf(rel, sizeof(rel), "many/f%05d.txt", i);
+        write_file(rel, "");
+    }
+    ASSERT_EQ(finder_open(TEST_DIR), 0);
+    finder_wait();
+    ASSERT_EQ(finder_count(), 8 + FINDER_PART_PATHS + 1000);
+
+    FinderMatch m[8];
+    ASSERT_EQ(finder_find("f01234", m, 8), 1);
+    ASSERT_TRUE(path_is(&m[0], "many/f01234.txt"));
+    int n = finder_find("f0", m, 8);
+    ASSERT_EQ(n, 8);
+    /* Ties in order, across the parts */
+    for (int i = 1; i < n; i++)
+        ASSERT_TRUE(m[i - 1].score > m[i].score ||
+                    (m[i - 1].score == m[i].score &&
+                     memcmp(m[i - 1].path, m[i].path, (size_t)m[i].len) < 0));
+    cleanup_tree();
+}
+
+TEST(finder_closed_finds_nothing) {
+    finder_close();
+    FinderMatch m[4];
+    ASSERT_EQ(finder_find("x", m, 4), -1);
+    ASSERT_EQ(finder_refresh(), -1);
+    ASSERT_EQ(finder_open("/tmp/loki_finder_test_missing"), -1);
+    ASSERT_TRUE(finder_root() == NULL);
+}
+
+BEGIN_TEST_SUITE("File Finder")
+    /* Listing and ranking */
+    RUN_TEST(finder_walk_lists_the_files);
+    RUN_TEST(finder_ranks_the_file_name_first);
+    RUN_TEST(finder_query_typed_on_scores_what_matched);
+    RUN_TEST(finder_large_list_is_scored_in_parts);
+
+    /* Keeping up with changes */
+    RUN_TEST(finder_reopen_uses_the_cached_list);
+    RUN_TEST(finder_wait_with_queue_full);
+    RUN_TEST(finder_marks_add_and_drop_paths);
+    RUN_TEST(finder_many_marks_walk_the_tree);
+    RUN_TEST(finder_closed_finds_nothing);
+END_TEST_SUITE()
@@ -0,0 +1,207 @@
+/* test_fold.c - Unit tests for code folding
+ *
+ * Tests for:
+ * - Adding folds, and refusing ones that cross
+ * - Mapping rows to screen rows and back past closed folds
+ * - Opening, closing and toggling nested folds
+ * - Folds following inserted and deleted lines
+ * - Folds from indentation
+ * - The screen and cursor motion skipping the rows of a closed fold
+ */
+
+#include "test_framework.h"
+#include "fold.h"
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+
+TEST(fold_add_refuses_crossing_folds) {
+    FoldSet *set = fold_set_new();
+    ASSERT_NOT_NULL(set);
+    ASSERT_EQ(fold_add(set, 10, 20, 1), 0);
+    ASSERT_EQ(fold_add(set, 12, 15, 1), 0);      /* Inside */
+    ASSERT_EQ(fold_add(set, 30, 40, 0), 0);
+    ASSERT_EQ(fold_add(set, 15, 25, 1), -1);     /* Crosses 10-20 */
+    ASSERT_EQ(fold_add(set, 5, 12, 1), -1);      /* Crosses 10-20 */
+    ASSERT_EQ(fold_add(set, 10, 18, 1), -1);     /* Same head */
+    ASSERT_EQ(fold_add(set, 7, 7, 1), -1);       /* One row */
+    ASSERT_EQ(fold_count(set), 3);
+    ASSERT_EQ(fold_hidden(set), 10);             /* 11-20 */
+    fold_set_free(set);
+}
+
+TEST(fold_maps_rows_past_closed_folds) {
+    FoldSet *set = fold_set_new();
+    fold_add(set, 2, 5, 1);     /* Hides 3-5 */
+    fold_add(set, 10, 12, 1);   /* Hides 11-12 */
+
+    ASSERT_EQ(fold_head(set, 4), 2);
+    ASSERT_EQ(fold_head(set, 6), 6);
+    ASSERT_EQ(fold_next(set, 2), 6);
+    ASSERT_EQ(fold_next(set, 1), 2);
+    ASSERT_EQ(fold_prev(set, 6), 2);
+    ASSERT_EQ(fold_prev(set, 13), 10);
+    ASSERT_EQ(fold_closed_last(set, 2), 5);
+    ASSERT_EQ(fold_closed_last(set, 3), -1);
+
+    /* Shown: 0 1 2 6 7 8 9 10 13 ... */
+    ASSERT_EQ(fold_screen_row(set, 2), 2);
+    ASSERT_EQ(fold_screen_row(set, 4), 2);
+    ASSERT_EQ(fold_screen_row(set, 6), 3);
+    ASSERT_EQ(fold_screen_row(set, 13), 8);
+    for (int y = 0; y < 20; y++)
+        ASSERT_EQ(fold_screen_row(set, fold_row(set, y)), y);
+    ASSERT_EQ(fold_row(set, 3), 6);
+    ASSERT_EQ(fold_row(set, 8), 13);
+
+    /* A NULL set has no folds */
+    ASSERT_EQ(fold_next(NULL, 4), 5);
+    ASSERT_EQ(fold_screen_row(NULL, 4), 4);
+    fold_set_free(set);
+}
+
+TEST(fold_open_close_and_toggle_nested) {
+    FoldSet *set = fold_set_new();
+    fold_add(set, 0, 20, 1);
+    fold_add(set, 5, 10, 1);
+
+    /* zo opens the outer fold; the inner one stays closed */
+    ASSERT_EQ(fold_open(set, 7), 1);
+    ASSERT_EQ(fold_head(set, 7), 5);
+    ASSERT_EQ(fold_hidden(set), 5);
+    ASSERT_EQ(fold_open(set, 7), 1);
+    ASSERT_EQ(fold_hidden(set), 0);
+    ASSERT_EQ(fold_open(set, 7), 0);
+
+    /* zc closes the innermost open fold */
+    ASSERT_EQ(fold_close(set, 7), 1);
+    ASSERT_EQ(fold_head(set, 7), 5);
+    ASSERT_EQ(fold_close(set, 7), 1);
+    ASSERT_EQ(fold_head(set, 7), 0);
+
+    unsigned long gen = fold_gen(set);
+    ASSERT_EQ(fold_toggle(set, 3), 1);
+    ASSERT_TRUE(fold_gen(set) != gen);
+    ASSERT_EQ(fold_head(set, 3), 3);
+    fold_set_all(set, 0);
+    ASSERT_EQ(fold_hidden(set), 0);
+    fold_set_all(set, 1);
+    ASSERT_EQ(fold_hidden(set), 20);
+    fold_clear(set);
+    ASSERT_EQ(fold_count(set), 0);
+    fold_set_free(set);
+}
+
+TEST(fold_follows_inserted_and_deleted_lines) {
+    FoldSet *set = fold_set_new();
+    fold_add(set, 10, 20, 1);
+    fold_add(set, 30, 32, 1);
+
+    /* Three lines inserted above: both move down */
+    fold_note_edit(set, 5, 0, 5, 0, 8, 0);
+    ASSERT_EQ(fold_closed_last(set, 13), 23);
+    ASSERT_EQ(fold_closed_last(set, 33), 35);
+
+    /* A line inserted inside the first fold grows it */
+    fold_note_edit(set, 15, 4, 15, 4, 16, 0);
+    ASSERT_EQ(fold_closed_last(set, 13), 24);
+    ASSERT_EQ(fold_closed_last(set, 34), 36);
+
+    /* Typing within a row moves nothing */
+    fold_note_edit(set, 13, 0, 13, 0, 13, 5);
+    ASSERT_EQ(fold_closed_last(set, 13), 24);
+
+    /* Deleting all but the head of the second fold drops it */
+    fold_note_edit(set, 34, 9, 36, 9, 34, 9);
+    ASSERT_EQ(fold_count(set), 1);
+    ASSERT_EQ(fold_closed_last(set, 34), -1);
+
+    /* Deleting lines 0-12 takes the head: the fold starts where they were */
+    fold_note_edit(set, 0, 0, 14, 0, 0, 0);
+    ASSERT_EQ(fold_closed_last(set, 0), 10);
+    fold_set_free(set);
+}
+
+static void add_rows(editor_ctx_t *ctx, const char **lines, int n) {
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+TEST(fold_from_indent_folds_blocks) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {
+        "int f(void) {",        /* 0 */
+        "    if (x) {",         /* 1 */
+        "        y();",         /* 2 */
+        "",                     /* 3 */
+        "        z();",         /* 4 */
+        "    }",                /* 5 */
+        "}",                    /* 6 */
+        "int g;",               /* 7 */
+    };
+    add_rows(&ctx, lines, 8);
+
+    ASSERT_EQ(fold_from_indent(&ctx), 2);
+    ASSERT_EQ(fold_closed_last(ctx.model.folds, 0), 5);
+    fold_open(ctx.model.folds, 0);
+    ASSERT_EQ(fold_closed_last(ctx.model.folds, 1), 4);
+    editor_ctx_free(&ctx);
+}
+
+TEST(screen_and_cursor_skip_closed_folds) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 5;
+    ctx.view.screencols = 80;
+    for (int i = 0; i < 20; i++) {
+        char line[16];
+        int len = snprintf(line, sizeof(line), "line %d", i);
+        editor_insert_row(&ctx, i, line, len);
+    }
+    ASSERT_EQ(editor_fold_add(&ctx.model, 1, 8, 1), 0);
+
+    int n, wrapped;
+    const ScreenLine *lines = editor_screen_lines(&ctx, 5, &n, &wrapped);
+    ASSERT_EQ(n, 5);
+    ASSERT_EQ(wrapped, 0);
+    ASSERT_EQ(lines[0].row, 0);
+    ASSERT_EQ(lines[1].row, 1);
+    ASSERT_EQ(lines[2].row, 9);
+    ASSERT_EQ(lines[4].row, 11);
+    ASSERT_EQ(lines[4].start, -1);
+
+    /* j from the head of the fold goes past it */
+    ctx.view.rowoff = 0;
+    ctx.view.cy = 1;
+    editor_move_cursor(&ctx, ARROW_DOWN);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 9);
+    ASSERT_EQ(editor_cursor_screen_row(&ctx), 2);
+    editor_move_cursor(&ctx, ARROW_UP);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 1);
+
+    /* Down to row 14: five screen rows, so the view scrolls by shown rows */
+    for (int i = 0; i < 6; i++) editor_move_cursor(&ctx, ARROW_DOWN);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 14);
+    ASSERT_EQ(editor_cursor_screen_row(&ctx), 4);
+    ASSERT_EQ(editor_screen_row_to_row(&ctx, 4, NULL), 14);
+
+    /* A cursor left inside a fold closed over it goes to its head */
+    ASSERT_EQ(editor_fold_add(&ctx.model, 12, 16, 1), 0);
+    editor_view_fix(&ctx);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 12);
+
+    /* Deleting a row above moves the folds up with it */
+    editor_del_row(&ctx, 0);
+    ASSERT_EQ(fold_closed_last(ctx.model.folds, 0), 7);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Fold")
+    RUN_TEST(fold_add_refuses_crossing_folds);
+    RUN_TEST(fold_maps_rows_past_closed_folds);
+    RUN_TEST(fold_open_close_and_toggle_nested);
+    RUN_TEST(fold_follows_inserted_and_deleted_lines);
+    RUN_TEST(fold_from_indent_folds_blocks);
+    RUN_TEST(screen_and_cursor_skip_closed_folds);
+END_TEST_SUITE()
@@ -0,0 +1,127 @@
+/* test_follow.c - Unit tests for following a growing file
+ *
+ * Tests for:
+ * - Appended lines read from the last offset and added as rows
+ * - A line written in parts completed on its row
+ * - The view keeping to the end, and edits refused
+ * - The row cap dropping the oldest rows
+ * - A truncated file read again from its start
+ */
+
+#include "test_framework.h"
+#include "follow.h"
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+#define TEST_FILE "/tmp/loki_test_follow.txt"
+
+static void write_file(const char *mode, const char *text) {
+    FILE *fp = fopen(TEST_FILE, mode);
+    fputs(text, fp);
+    fclose(fp);
+}
+
+static int cursor_row(editor_ctx_t *ctx) {
+    return ctx->view.rowoff + ctx->view.cy;
+}
+
+TEST(follow_appends_new_lines) {
+    write_file("w", "one\ntwo\nthree\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 2;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_EQ(follow_start(&ctx, 0), 0);
+    ASSERT_EQ(cursor_row(&ctx), 2);
+    ASSERT_EQ(follow_read(&ctx), 0);
+
+    /* Whole lines, then the start of one */
+    write_file("a", "four\nfi");
+    ASSERT_EQ(follow_read(&ctx), 2);
+    ASSERT_EQ(ctx.model.numrows, 5);
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "four");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "fi");
+    ASSERT_EQ(cursor_row(&ctx), 4);
+
+    /* The rest of it */
+    write_file("a", "ve\r\nsix\n");
+    ASSERT_EQ(follow_read(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "five");
+    ASSERT_STR_EQ(ctx.model.row[5].chars, "six");
+    ASSERT_EQ(ctx.model.dirty, 0);
+
+    /* Moved up, the view stays */
+    editor_cursor_to(&ctx, 1, 0);
+    write_file("a", "seven\n");
+    ASSERT_EQ(follow_read(&ctx), 1);
+    ASSERT_EQ(cursor_row(&ctx), 1);
+
+    /* Read-only */
+    editor_insert_char(&ctx, 'x');
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "two");
+
+    follow_stop(&ctx.model);
+    ASSERT_NULL(ctx.model.follow);
+    editor_insert_char(&ctx, 'x');
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "xtwo");
+
+    editor_ctx_free(&ctx);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);   /* Close the watch */
+    remove(TEST_FILE);
+}
+
+TEST(follow_caps_rows) {
+    write_file("w", "1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 4;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+
+    /* The cap applies at once */
+    ASSERT_EQ(follow_start(&ctx, 16), 0);
+    ASSERT_EQ(follow_start(&ctx, 8), 0);
+    ASSERT_EQ(ctx.model.numrows, 8);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "3");
+    ASSERT_EQ(cursor_row(&ctx), 7);
+
+    /* Then once an eighth over it */
+    write_file("a", "11\n");
+    follow_read(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 9);
+    write_file("a", "12\n13\n");
+    follow_read(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 8);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "6");
+    ASSERT_STR_EQ(ctx.model.row[7].chars, "13");
+    ASSERT_EQ(cursor_row(&ctx), 7);
+
+    editor_ctx_free(&ctx);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    remove(TEST_FILE);
+}
+
+TEST(follow_rereads_truncated_file) {
+    write_file("w", "old line\nanother\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    ASSERT_EQ(follow_start(&ctx, 0), 0);
+
+    write_file("w", "new\n");
+    ASSERT_EQ(follow_read(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "new");
+
+    editor_ctx_free(&ctx);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    remove(TEST_FILE);
+}
+
+BEGIN_TEST_SUITE("Follow")
+    RUN_TEST(follow_appends_new_lines);
+    RUN_TEST(follow_caps_rows);
+    RUN_TEST(follow_rereads_truncated_file);
+END_TEST_SUITE()
@@ -0,0 +1,132 @@
+/* test_frame_pacer.c - Unit tests for render scheduling
+ *
+ * Tests for:
+ * - Frames only when damaged or when the screen stamp changes
+ * - At most one frame per interval, with the wait rounded up
+ * - Input burst draining within one frame
+ * - Frame rate setting and clamping
+ * - editor_screen_stamp() following visible state
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "frame_pacer.h"
+#include <string.h>
+
+#define MS 1000000ULL
+
+TEST(pacer_first_frame_is_due) {
+    FramePacer p;
+    frame_pacer_init(&p);
+    ASSERT_TRUE(frame_pacer_ready(&p, 5 * MS));
+    ASSERT_EQ(frame_pacer_timeout(&p, 5 * MS), 0);
+}
+
+TEST(pacer_idle_without_damage) {
+    FramePacer p;
+    frame_pacer_set_rate(100);
+    frame_pacer_init(&p);
+    frame_pacer_drawn(&p, 1000 * MS, 42);
+
+    ASSERT_FALSE(frame_pacer_ready(&p, 2000 * MS));
+    ASSERT_EQ(frame_pacer_timeout(&p, 2000 * MS), -1);
+
+    /* Same state: still nothing to draw */
+    frame_pacer_note_state(&p, 42);
+    ASSERT_FALSE(frame_pacer_ready(&p, 2000 * MS));
+
+    /* Changed state: draw */
+    frame_pacer_note_state(&p, 43);
+    ASSERT_TRUE(frame_pacer_ready(&p, 2000 * MS));
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+}
+
+TEST(pacer_limits_frame_rate) {
+    FramePacer p;
+    frame_pacer_set_rate(100);  /* 10 ms frames */
+    frame_pacer_init(&p);
+    frame_pacer_drawn(&p, 1000 * MS, 1);
+
+    frame_pacer_damage(&p);
+    ASSERT_FALSE(frame_pacer_ready(&p, 1004 * MS));
+    ASSERT_EQ(frame_pacer_timeout(&p, 1004 * MS), 6);
+    /* Partial milliseconds round up */
+    ASSERT_EQ(frame_pacer_timeout(&p, 1004 * MS + 1), 6);
+    ASSERT_EQ(frame_pacer_timeout(&p, 1009 * MS + 1), 1);
+    ASSERT_TRUE(frame_pacer_ready(&p, 1010 * MS));
+    ASSERT_EQ(frame_pacer_timeout(&p, 1010 * MS), 0);
+
+    frame_pacer_drawn(&p, 1010 * MS, 1);
+    ASSERT_FALSE(frame_pacer_ready(&p, 1030 * MS));
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+}
+
+TEST(pacer_unlimited_rate_draws_on_damage) {
+    FramePacer p;
+    frame_pacer_set_rate(0);
+    frame_pacer_init(&p);
+    frame_pacer_drawn(&p, 1000 * MS, 1);
+    frame_pacer_damage(&p);
+    ASSERT_TRUE(frame_pacer_ready(&p, 1000 * MS));
+    ASSERT_TRUE(frame_pacer_within_frame(0, 1000000 * MS));
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+}
+
+TEST(pacer_burst_ends_with_frame) {
+    frame_pacer_set_rate(125);  /* 8 ms frames */
+    ASSERT_TRUE(frame_pacer_within_frame(100 * MS, 100 * MS));
+    ASSERT_TRUE(frame_pacer_within_frame(100 * MS, 107 * MS));
+    ASSERT_FALSE(frame_pacer_within_frame(100 * MS, 108 * MS));
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+}
+
+TEST(pacer_rate_is_clamped) {
+    frame_pacer_set_rate(-3);
+    ASSERT_EQ(frame_pacer_get_rate(), 0);
+    frame_pacer_set_rate(FRAME_RATE_MAX + 1);
+    ASSERT_EQ(frame_pacer_get_rate(), FRAME_RATE_MAX);
+    frame_pacer_set_rate(FRAME_RATE_DEFAULT);
+    ASSERT_EQ(frame_pacer_get_rate(), FRAME_RATE_DEFAULT);
+}
+
+TEST(screen_stamp_follows_visible_state) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+
+    uint64_t base = editor_screen_stamp(&ctx);
+    ASSERT_TRUE(base != 0);
+    ASSERT_TRUE(editor_screen_stamp(&ctx) == base);
+
+    ctx.view.cx = 3;
+    uint64_t moved = editor_screen_stamp(&ctx);
+    ASSERT_TRUE(moved != base);
+
+    ctx.model.damage_gen++;
+    uint64_t edited = editor_screen_stamp(&ctx);
+    ASSERT_TRUE(edited != moved);
+
+    editor_set_status_msg(&ctx, "hello");
+    uint64_t msg = editor_screen_stamp(&ctx);
+    ASSERT_TRUE(msg != edited);
+    editor_set_status_msg(&ctx, "world");
+    ASSERT_TRUE(editor_screen_stamp(&ctx) != msg);
+
+    /* An expired message no longer shows */
+    ctx.view.statusmsg_time -= 10;
+    ASSERT_TRUE(editor_screen_stamp(&ctx) == edited);
+
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Frame Pacer")
+    RUN_TEST(pacer_first_frame_is_due);
+    RUN_TEST(pacer_idle_without_damage);
+    RUN_TEST(pacer_limits_frame_rate);
+    RUN_TEST(pacer_unlimited_rate_draws_on_damage);
+    RUN_TEST(pacer_burst_ends_with_frame);
+    RUN_TEST(pacer_rate_is_clamped);
+    RUN_TEST(screen_stamp_follows_visible_state);
+END_TEST_SUITE()
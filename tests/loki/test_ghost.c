@@ -0,0 +1,155 @@
+/* test_ghost.c - Unit tests for inline suggestions
+ *
+ * Tests for:
+ * - A ghost drawn after its row's text, with a count of its further lines,
+ *   and not in the rows
+ * - Streamed tokens damaging only the ghost's row, recording no undo
+ * - Accepting as one insert undone in one step; stale after an edit
+ * - TAB in INSERT mode accepting, other keys dropping it
+ */
+
+#include "test_framework.h"
+#include "ghost.h"
+#include "internal.h"
+#include "modal.h"
+#include "undo.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void fill(editor_ctx_t *ctx, const char **lines, int n) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+TEST(ghost_drawn_after_row) {
+    const char *lines[] = { "int x = ", "next" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 2);
+    ghost_show(&ctx, 0, 8, "42;\t//\x01 a\nmore\nlast", 19);
+    ASSERT_TRUE(ghost_active(&ctx));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "int x = ");
+
+    const char *text;
+    int len, more;
+    ASSERT_TRUE(ghost_row(&ctx.model, 0, &text, &len, &more));
+    ASSERT_EQ(len, 12);
+    ASSERT_EQ(strncmp(text, "42;     // a", 12), 0);
+    ASSERT_EQ(more, 2);
+    ASSERT_FALSE(ghost_row(&ctx.model, 1, &text, &len, &more));
+
+    RenderSegment *segs = NULL;
+    int cap = 0;
+    int n = editor_row_segments(&ctx, &ctx.model.row[0], 0, 0, 80, &segs, &cap);
+    ASSERT_TRUE(n >= 3);
+    ASSERT_TRUE(segs[n - 2].text == text);
+    ASSERT_EQ(segs[n - 2].hl_type, HL_TYPE_COMMENT);
+    ASSERT_EQ(segs[n - 1].len, 12);
+    ASSERT_EQ(strncmp(segs[n - 1].text, "  [+2 lines]", 12), 0);
+
+    /* Cut to the room left on the screen line */
+    n = editor_row_segments(&ctx, &ctx.model.row[0], 0, 0, 10, &segs, &cap);
+    ASSERT_EQ(segs[n - 1].len, 2);
+    ASSERT_TRUE(segs[n - 1].text == text);
+
+    ghost_clear(&ctx);
+    ASSERT_FALSE(ghost_active(&ctx));
+    n = editor_row_segments(&ctx, &ctx.model.row[0], 0, 0, 80, &segs, &cap);
+    for (int i = 0; i < n; i++) ASSERT_TRUE(segs[i].hl_type != HL_TYPE_COMMENT);
+    free(segs);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ghost_streams_without_edits) {
+    const char *lines[] = { "a", "b", "c" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 3);
+    ctx.view.cy = 1;
+    ctx.view.cx = 1;
+    undo_break_group(&ctx);
+    int levels, redo, after;
+    size_t memory;
+    undo_get_stats(&ctx, &levels, &redo, &memory);
+    int dirty = ctx.model.dirty;
+    unsigned long gen0 = ctx.model.row[0].damage_gen;
+    unsigned long gen2 = ctx.model.row[2].damage_gen;
+
+    for (int i = 0; i < 100; i++) {
+        unsigned long before = ctx.model.row[1].damage_gen;
+        ghost_append(&ctx, "tok ", 4);
+        ASSERT_TRUE(ctx.model.row[1].damage_gen > before);
+    }
+    ASSERT_EQ(ctx.model.row[0].damage_gen, gen0);
+    ASSERT_EQ(ctx.model.row[2].damage_gen, gen2);
+    ASSERT_EQ(ctx.model.dirty, dirty);
+    undo_get_stats(&ctx, &after, &redo, &memory);
+    ASSERT_EQ(after, levels);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "b");
+
+    size_t len;
+    const char *text = ghost_text(&ctx, &len);
+    ASSERT_EQ(len, 400);
+    ASSERT_EQ(strncmp(text, "tok tok ", 8), 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ghost_accept_is_one_edit) {
+    const char *lines[] = { "foo(", "end" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 2);
+    undo_break_group(&ctx);
+    ctx.view.cy = 1;
+    ghost_show(&ctx, 0, 4, "a,", 2);
+    ghost_append(&ctx, " b);\nbar();", 11);
+    ASSERT_TRUE(ghost_accept(&ctx));
+    ASSERT_FALSE(ghost_active(&ctx));
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "foo(a, b);");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "bar();");
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 1);
+    ASSERT_EQ(ctx.view.coloff + ctx.view.cx, 6);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "foo(");
+    ASSERT_FALSE(ghost_accept(&ctx));
+
+    /* An edit leaves a ghost stale: not drawn, not taken */
+    ghost_show(&ctx, 1, 3, "!", 1);
+    editor_row_set(&ctx, &ctx.model.row[0], "bar(", 4);
+    const char *text;
+    int len, more;
+    ASSERT_FALSE(ghost_row(&ctx.model, 1, &text, &len, &more));
+    ASSERT_FALSE(ghost_accept(&ctx));
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "end");
+    ASSERT_TRUE(ctx.model.ghost == NULL);
+    editor_ctx_free(&ctx);
+}
+
+TEST(ghost_keys_in_insert_mode) {
+    const char *lines[] = { "x = " };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 1);
+    ctx.view.mode = MODE_INSERT;
+    ctx.view.cx = 4;
+    ghost_append(&ctx, "1 + 2", 5);
+    modal_process_insert_mode_key(&ctx, 0, TAB);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "x = 1 + 2");
+    ASSERT_EQ(ctx.view.cx, 9);
+
+    /* Any other key drops it, and does what it does */
+    ghost_append(&ctx, ";", 1);
+    modal_process_insert_mode_key(&ctx, 0, 'y');
+    ASSERT_FALSE(ghost_active(&ctx));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "x = 1 + 2y");
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Ghost text")
+    RUN_TEST(ghost_drawn_after_row);
+    RUN_TEST(ghost_streams_without_edits);
+    RUN_TEST(ghost_accept_is_one_edit);
+    RUN_TEST(ghost_keys_in_insert_mode);
+END_TEST_SUITE()
@@ -0,0 +1,223 @@
+/* test_grep.c - Unit tests for project-wide search
+ *
+ * Tests for:
+ * - The .gitignore-style skip list
+ * - Finding matches in a tree, and skipping binary and ignored files
+ * - Plain text and case-insensitive patterns
+ * - Trees bigger than one worker's share
+ * - Stopping early, and errors
+ */
+
+#include "test_framework.h"
+#include "grep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_grep_test"
+
+static void write_file(const char *rel, const char *content, size_t len) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return;
+    fwrite(content, 1, len, fp);
+    fclose(fp);
+}
+
+static void make_dir(const char *rel) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    mkdir(path, 0755);
+}
+
+/* A small tree: two matching files, plus matches that must be skipped */
+static void setup_tree(void) {
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    make_dir("src");
+    make_dir(".git");
+    make_dir("build");
+    write_file("src/main.c", "int main(void) {\n    return answer();\n}\n", 40);
+    write_file("src/answer.c", "int answer(void)\r\n{ return 42; }", 32);
+    write_file("notes.txt", "nothing here\nuse answer() above\n", 32);
+    write_file("blob.bin", "answer\0\1\2", 9);
+    write_file(".git/config", "answer\n", 7);
+    write_file("build/out.c", "answer\n", 7);
+    write_file("debug.log", "answer\n", 7);
+    write_file(".gitignore", "# build output\nbuild/\n*.log\n", 28);
+}
+
+static void cleanup_tree(void) {
+    system("rm -rf " TEST_DIR);
+}
+
+/* Collected matches as "path:line:col:text" lines, sorted */
+typedef struct {
+    char lines[64][128];
+    int count;
+    int stop_after;
+} Results;
+
+static int collect(const GrepMatch *m, void *arg) {
+    Results *r = arg;
+    if (r->count < 64) {
+        const char *path = m->path + strlen(TEST_DIR "/");
+        snprintf(r->lines[r->count], sizeof(r->lines[0]), "%s:%d:%d:%.*s",
+                 path, m->line, m->col, m->len, m->text);
+    }
+    r->count++;
+    return r->stop_after && r->count >= r->stop_after;
+}
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+static void sort_results(Results *r) {
+    qsort(r->lines, (size_t)(r->count < 64 ? r->count : 64),
+          sizeof(r->lines[0]), compare_lines);
+}
+
+/* ======================= Skip List ========================================= */
+
+TEST(grep_ignore_follows_gitignore_rules) {
+    GrepIgnore *ig = grep_ignore_load("/nonexistent");
+    ASSERT_NOT_NULL(ig);
+    grep_ignore_add(ig, "*.o");
+    grep_ignore_add(ig, "!keep.o");
+    grep_ignore_add(ig, "tmp/");
+    grep_ignore_add(ig, "/docs/*.html");
+    grep_ignore_add(ig, "**/cache/data");
+    grep_ignore_add(ig, "   ");
+    grep_ignore_add(ig, "# a comment");
+
+    /* Built in */
+    ASSERT_TRUE(grep_ignore_match(ig, ".git", 1));
+    ASSERT_TRUE(grep_ignore_match(ig, "sub/.git", 1));
+    /* No '/': the name at any depth */
+    ASSERT_TRUE(grep_ignore_match(ig, "a.o", 0));
+    ASSERT_TRUE(grep_ignore_match(ig, "x/y/a.o", 0));
+    ASSERT_FALSE(grep_ignore_match(ig, "a.c", 0));
+    /* A later '!' takes a path back */
+    ASSERT_FALSE(grep_ignore_match(ig, "lib/keep.o", 0));
+    /* Trailing '/': directories only */
+    ASSERT_TRUE(grep_ignore_match(ig, "src/tmp", 1));
+    ASSERT_FALSE(grep_ignore_match(ig, "src/tmp", 0));
+    /* With a '/': the path from the root */
+    ASSERT_TRUE(grep_ignore_match(ig, "docs/index.html", 0));
+    ASSERT_FALSE(grep_ignore_match(ig, "a/docs/index.html", 0));
+    ASSERT_FALSE(grep_ignore_match(ig, "docs/api/index.html", 0));
+    /* Leading "**" + "/": from any directory */
+    ASSERT_TRUE(grep_ignore_match(ig, "cache/data", 1));
+    ASSERT_TRUE(grep_ignore_match(ig, "a/b/cache/data", 0));
+    ASSERT_FALSE(grep_ignore_match(ig, "a/cache/data2", 0));
+    grep_ignore_free(ig);
+}
+
+/* ======================= Searching ========================================= */
+
+TEST(grep_run_finds_matching_lines) {
+    setup_tree();
+    Results r = {0};
+    const char *error = NULL;
+    long files = grep_run("answer\\(", TEST_DIR, 0, collect, &r, &error);
+    sort_results(&r);
+
+    /* main.c, answer.c, notes.txt, blob.bin and .gitignore are searched */
+    ASSERT_EQ(files, 5);
+    ASSERT_EQ(r.count, 3);
+    ASSERT_STR_EQ(r.lines[0], "notes.txt:2:5:use answer() above");
+    ASSERT_STR_EQ(r.lines[1], "src/answer.c:1:5:int answer(void)");
+    ASSERT_STR_EQ(r.lines[2], "src/main.c:2:12:    return answer();");
+    cleanup_tree();
+}
+
+TEST(grep_run_searches_plain_text_and_ignores_case) {
+    setup_tree();
+    Results r = {0};
+    const char *error = NULL;
+
+    /* '(' and ')' are themselves; the line's first match is reported */
+    grep_run("answer()", TEST_DIR, GREP_LITERAL, collect, &r, &error);
+    sort_results(&r);
+    ASSERT_EQ(r.count, 2);
+    ASSERT_STR_EQ(r.lines[0], "notes.txt:2:5:use answer() above");
+    ASSERT_STR_EQ(r.lines[1], "src/main.c:2:12:    return answer();");
+
+    memset(&r, 0, sizeof(r));
+    grep_run("INT ", TEST_DIR, GREP_LITERAL | GREP_ICASE, collect, &r, &error);
+    ASSERT_EQ(r.count, 2);
+
+    memset(&r, 0, sizeof(r));
+    grep_run("^int", TEST_DIR "/src/main.c", 0, collect, &r, &error);
+    ASSERT_EQ(r.count, 1);
+    cleanup_tree();
+}
+
+TEST(grep_run_spreads_a_large_tree_over_the_workers) {
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    /* One wide directory and one deep chain */
+    char rel[256], text[64];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(rel, sizeof(rel), "f%d.txt", i);
+        int n = snprintf(text, sizeof(text), "line\nneedle %d\n", i);
+        write_file(rel, text, (size_t)n);
+    }
+    rel[0] = '\0';
+    for (int d = 0; d < 40; d++) {
+        size_t len = strlen(rel);
+        snprintf(rel + len, sizeof(rel) - len, "%sd", len ? "/" : "");
+        make_dir(rel);
+        char file[300];
+        snprintf(file, sizeof(file), "%s/x.txt", rel);
+        write_file(file, "needle\n", 7);
+    }
+
+    Results r = {0};
+    const char *error = NULL;
+    long files = grep_run("needle", TEST_DIR, GREP_LITERAL, collect, &r, &error);
+    ASSERT_EQ(files, 2040);
+    ASSERT_EQ(r.count, 2040);
+    cleanup_tree();
+}
+
+TEST(grep_run_stops_when_the_callback_asks) {
+    setup_tree();
+    Results r = {0};
+    r.stop_after = 1;
+    const char *error = NULL;
+    grep_run("answer", TEST_DIR, 0, collect, &r, &error);
+    ASSERT_EQ(r.count, 1);
+    cleanup_tree();
+}
+
+/* ======================= Errors ============================================ */
+
+TEST(grep_run_reports_bad_patterns_and_roots) {
+    Results r = {0};
+    const char *error = NULL;
+    ASSERT_EQ(grep_run("(", "/tmp", 0, collect, &r, &error), -1);
+    ASSERT_NOT_NULL(error);
+
+    error = NULL;
+    ASSERT_EQ(grep_run("x", TEST_DIR "/missing", 0, collect, &r, &error), -1);
+    ASSERT_NOT_NULL(error);
+    ASSERT_EQ(r.count, 0);
+}
+
+BEGIN_TEST_SUITE("Project Search")
+    /* Skip list */
+    RUN_TEST(grep_ignore_follows_gitignore_rules);
+
+    /* Searching */
+    RUN_TEST(grep_run_finds_matching_lines);
+    RUN_TEST(grep_run_searches_plain_text_and_ignores_case);
+    RUN_TEST(grep_run_spreads_a_large_tree_over_the_workers);
+    RUN_TEST(grep_run_stops_when_the_callback_asks);
+
+    /* Errors */
+    RUN_TEST(grep_run_reports_bad_patterns_and_roots);
+END_TEST_SUITE()
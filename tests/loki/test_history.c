@@ -0,0 +1,228 @@
+/* test_history.c - Unit tests for command and REPL history kept on disk
+ *
+ * Tests for:
+ * - Entries kept across opens, newest first, repeats of the newest dropped
+ * - Prefix searches going back through distinct entries
+ * - Logs shared by several handles and processes
+ * - A record cut short at the end dropped
+ * - Logs rewritten with their newest entries, and cleared
+ */
+
+#include "test_framework.h"
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_DIR "/tmp/loki_history_test"
+#define TEST_LOG TEST_DIR "/cmd_history.log"
+
+static void setup(void) {
+    system("rm -rf " TEST_DIR);
+    history_set_dir(TEST_DIR);
+}
+
+static void teardown(void) {
+    system("rm -rf " TEST_DIR);
+    history_set_dir(NULL);
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+TEST(history_keeps_entries) {
+    setup();
+    HistoryLog *h = history_open("cmd");
+    ASSERT_NOT_NULL(h);
+    ASSERT_EQ(history_count(h), 0);
+    ASSERT_NULL(history_get(h, 0));
+    ASSERT_EQ(history_add(h, "w"), 0);
+    ASSERT_EQ(history_add(h, "set nu"), 0);
+    ASSERT_EQ(history_add(h, "set nu"), 0);
+    ASSERT_EQ(history_add(h, ""), 0);
+    ASSERT_EQ(history_add(h, "q"), 0);
+    ASSERT_EQ(history_count(h), 3);
+    ASSERT_STR_EQ(history_get(h, 0), "q");
+    ASSERT_STR_EQ(history_get(h, 2), "w");
+    ASSERT_NULL(history_get(h, 3));
+    history_close(h);
+
+    /* Opened again: counted from the last record alone */
+    h = history_open("cmd");
+    ASSERT_EQ(history_count(h), 3);
+    ASSERT_STR_EQ(history_get(h, 1), "set nu");
+    ASSERT_STR_EQ(history_get(h, 0), "q");
+    history_close(h);
+    ASSERT_TRUE(file_size(TEST_LOG) > 0);
+    teardown();
+}
+
+TEST(history_finds_by_prefix) {
+    setup();
+    HistoryLog *h = history_open("cmd");
+    const char *entries[] = {
+        "set nu", "grep foo", "set wrap", "w", "set nu", "set list", "set wrap", "q",
+    };
+    for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); i++)
+        history_add(h, entries[i]);
+
+    /* Newest first, each text once */
+    int age = history_find(h, "set", 3, 0);
+    ASSERT_STR_EQ(history_get(h, age), "set wrap");
+    age = history_find(h, "set", 3, age + 1);
+    ASSERT_STR_EQ(history_get(h, age), "set list");
+    age = history_find(h, "set", 3, age + 1);
+    ASSERT_STR_EQ(history_get(h, age), "set nu");
+    ASSERT_EQ(history_find(h, "set", 3, age + 1), -1);
+
+    /* Short and long prefixes, and the empty one */
+    ASSERT_STR_EQ(history_get(h, history_find(h, "g", 1, 0)), "grep foo");
+    ASSERT_STR_EQ(history_get(h, history_find(h, "set li", 6, 0)), "set list");
+    ASSERT_EQ(history_find(h, "set lists", 9, 0), -1);
+    ASSERT_EQ(history_find(h, "", 0, 0), 0);
+    history_close(h);
+    teardown();
+}
+
+TEST(history_shared_between_handles) {
+    setup();
+    HistoryLog *a = history_open("cmd");
+    HistoryLog *b = history_open("cmd");
+    history_add(a, "one");
+    history_add(b, "two");
+    history_add(a, "three");
+    ASSERT_EQ(history_count(a), 3);
+    ASSERT_STR_EQ(history_get(a, 1), "two");
+
+    /* b sees a's last entry once it looks */
+    ASSERT_EQ(history_count(b), 2);
+    history_refresh(b);
+    ASSERT_EQ(history_count(b), 3);
+    ASSERT_STR_EQ(history_get(b, 0), "three");
+    ASSERT_STR_EQ(history_get(b, 2), "one");
+    history_close(a);
+    history_close(b);
+
+    /* Processes adding at once: no entry lost or torn */
+    for (int p = 0; p < 2; p++) {
+        if (fork() == 0) {
+            HistoryLog *h = history_open("cmd");
+            char text[32];
+            for (int i = 0; i < 200; i++) {
+                snprintf(text, sizeof(text), "p%d entry %d", p, i);
+                history_add(h, text);
+            }
+            history_close(h);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) {}
+    HistoryLog *h = history_open("cmd");
+    ASSERT_EQ(history_count(h), 403);
+    int seen[2] = {0, 0};
+    for (int age = 0; age < 400; age++) {
+        int p, i;
+        ASSERT_EQ(sscanf(history_get(h, age), "p%d entry %d", &p, &i), 2);
+        seen[p]++;
+    }
+    ASSERT_EQ(seen[0], 200);
+    ASSERT_EQ(seen[1], 200);
+    history_close(h);
+    teardown();
+}
+
+TEST(history_drops_a_record_cut_short) {
+    setup();
+    HistoryLog *h = history_open("cmd");
+    history_add(h, "e one.txt");
+    history_add(h, "e two.txt");
+    history_close(h);
+    long size = file_size(TEST_LOG);
+
+    FILE *f = fopen(TEST_LOG, "a");
+    fwrite("LKHR\x02\0\0\0\x09\0\0\0", 1, 12, f);
+    fclose(f);
+    h = history_open("cmd");
+    ASSERT_EQ(history_count(h), 2);
+    ASSERT_STR_EQ(history_get(h, 0), "e two.txt");
+    ASSERT_EQ(file_size(TEST_LOG), size);
+    history_add(h, "e three.txt");
+    history_close(h);
+
+    h = history_open("cmd");
+    ASSERT_EQ(history_count(h), 3);
+    ASSERT_STR_EQ(history_get(h, 0), "e three.txt");
+    ASSERT_STR_EQ(history_get(h, 2), "e one.txt");
+    history_close(h);
+    teardown();
+}
+
+TEST(history_rewritten_past_its_size) {
+    setup();
+    HistoryLog *a = history_open("cmd");
+    HistoryLog *b = history_open("cmd");
+    char text[128];
+    int n = 0;
+    while (file_size(TEST_LOG) + 200 < (long)HISTORY_LOG_MAX) {
+        snprintf(text, sizeof(text), "s/entry %06d/%0100d/", n, n);
+        history_add(a, text);
+        n++;
+    }
+    int before = history_count(a);
+    for (int i = 0; i < 4; i++, n++) {
+        snprintf(text, sizeof(text), "s/entry %06d/%0100d/", n, n);
+        history_add(a, text);
+    }
+    ASSERT_TRUE(file_size(TEST_LOG) <= (long)HISTORY_LOG_KEEP + 4 * 200);
+    ASSERT_TRUE(history_count(a) < before);
+    snprintf(text, sizeof(text), "s/entry %06d/%0100d/", n - 1, n - 1);
+    ASSERT_STR_EQ(history_get(a, 0), text);
+
+    /* The other handle moves to the new file */
+    history_add(b, "w");
+    ASSERT_EQ(history_count(b), history_count(a) + 1);
+    ASSERT_STR_EQ(history_get(b, 1), text);
+    history_refresh(a);
+    ASSERT_STR_EQ(history_get(a, 0), "w");
+
+    /* Cleared for both */
+    ASSERT_EQ(history_clear(b), 0);
+    ASSERT_EQ(history_count(b), 0);
+    history_refresh(a);
+    ASSERT_EQ(history_count(a), 0);
+    history_add(a, "q");
+    history_refresh(b);
+    ASSERT_STR_EQ(history_get(b, 0), "q");
+    history_close(a);
+    history_close(b);
+    teardown();
+}
+
+TEST(history_private_without_a_directory) {
+    setup();
+    history_set_dir("");
+    HistoryLog *h = history_open("cmd");
+    ASSERT_NOT_NULL(h);
+    history_add(h, "set nu");
+    ASSERT_STR_EQ(history_get(h, 0), "set nu");
+    history_close(h);
+    ASSERT_EQ(file_size(TEST_LOG), -1);
+    h = history_open("cmd");
+    ASSERT_EQ(history_count(h), 0);
+    history_close(h);
+    teardown();
+}
+
+BEGIN_TEST_SUITE("History")
+    RUN_TEST(history_keeps_entries);
+    RUN_TEST(history_finds_by_prefix);
+    RUN_TEST(history_shared_between_handles);
+    RUN_TEST(history_drops_a_record_cut_short);
+    RUN_TEST(history_rewritten_past_its_size);
+    RUN_TEST(history_private_without_a_directory);
+END_TEST_SUITE()
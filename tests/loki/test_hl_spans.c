@@ -0,0 +1,117 @@
+/* test_hl_spans.c - Unit tests for run-length encoded highlight
+ *
+ * Tests for:
+ * - Run counting and encoding of highlight bytes
+ * - Packed blocks: unpacking, lookup and clipping to a window
+ * - Growing past the inline capacity
+ * - Rows packing their highlight, and unpacking it to be written
+ */
+
+#include "test_framework.h"
+#include "hl_spans.h"
+#include "internal.h"
+#include "syntax.h"
+#include <stdlib.h>
+#include <string.h>
+
+TEST(hl_runs_are_counted_and_encoded) {
+    unsigned char hl[40];
+    memset(hl, HL_NORMAL, sizeof(hl));
+    memset(hl + 3, HL_KEYWORD1, 4);
+    memset(hl + 20, HL_COMMENT, 20);
+    ASSERT_EQ(hl_run_count(hl, 40), 4);
+    ASSERT_EQ(hl_run_count(hl, 0), 0);
+    ASSERT_EQ(hl_run_end(hl, 7, 40), 20);
+
+    HlSpans spans;
+    hl_spans_init(&spans);
+    hl_spans_from_bytes(&spans, hl, 0, 40);
+    ASSERT_EQ(spans.count, 4);
+    ASSERT_EQ(spans.span[1].start, 3);
+    ASSERT_EQ(spans.span[1].len, 4);
+    ASSERT_EQ(spans.span[1].hl, HL_KEYWORD1);
+    ASSERT_EQ(spans.span[3].start, 20);
+    ASSERT_EQ(spans.span[3].len, 20);
+    hl_spans_free(&spans);
+}
+
+TEST(hl_span_blocks_round_trip) {
+    unsigned char hl[100], back[100];
+    for (int i = 0; i < 100; i++) hl[i] = (unsigned char)(i / 10 % 3 + 2);
+    int count = hl_run_count(hl, 100);
+    ASSERT_EQ(count, 10);
+
+    HlSpanBlock *block = hl_span_block_pack(hl, 100, count);
+    ASSERT_NOT_NULL(block);
+    ASSERT_EQ(block->count, 10);
+    hl_span_block_unpack(block, 0, 100, back);
+    ASSERT_EQ(memcmp(hl, back, 100), 0);
+
+    /* A window of it, and single columns */
+    hl_span_block_unpack(block, 15, 30, back);
+    ASSERT_EQ(memcmp(hl + 15, back, 30), 0);
+    ASSERT_EQ(hl_span_block_at(block, 0), hl[0]);
+    ASSERT_EQ(hl_span_block_at(block, 59), hl[59]);
+    ASSERT_EQ(hl_span_block_at(block, 100), HL_NORMAL);
+
+    /* Clipped runs start from the window */
+    HlSpans spans;
+    hl_spans_init(&spans);
+    hl_spans_from_block(&spans, block, 15, 30);
+    ASSERT_EQ(spans.count, 4);
+    ASSERT_EQ(spans.span[0].start, 0);
+    ASSERT_EQ(spans.span[0].len, 5);
+    ASSERT_EQ(spans.span[3].start, 25);
+    ASSERT_EQ(spans.span[3].len, 5);
+    hl_spans_free(&spans);
+    free(block);
+}
+
+TEST(hl_spans_grow_past_inline_capacity) {
+    HlSpans spans;
+    hl_spans_init(&spans);
+    for (int i = 0; i < HL_SPANS_INLINE * 3; i++)
+        hl_spans_push(&spans, i, 1, (unsigned char)(i % 2));
+    ASSERT_EQ(spans.count, HL_SPANS_INLINE * 3);
+    ASSERT_TRUE(spans.span != spans.inline_span);
+    ASSERT_EQ(spans.span[HL_SPANS_INLINE * 3 - 1].start, HL_SPANS_INLINE * 3 - 1);
+
+    /* A run continuing the last one extends it */
+    hl_spans_free(&spans);
+    hl_spans_push(&spans, 0, 4, HL_STRING);
+    hl_spans_push(&spans, 4, 4, HL_STRING);
+    ASSERT_EQ(spans.count, 1);
+    ASSERT_EQ(spans.span[0].len, 8);
+    hl_spans_free(&spans);
+}
+
+TEST(rows_pack_highlight_and_unpack_to_write) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    syntax_select_for_filename(&ctx, "test.c");
+    char line[200];
+    memset(line, ' ', sizeof(line));
+    memcpy(line, "// ", 3);
+    editor_insert_row(&ctx, 0, line, sizeof(line));
+
+    t_erow *row = syntax_fresh_row(&ctx, 0);
+    ASSERT_TRUE(row->arena_bufs & ROW_BUF_SPANS);
+    ASSERT_EQ(row->hl_buf.hl_spans->count, 1);
+    ASSERT_EQ(editor_row_hl_at(row, 150), HL_COMMENT);
+
+    unsigned char *hl = editor_row_hl(row);
+    ASSERT_NOT_NULL(hl);
+    ASSERT_FALSE(row->arena_bufs & ROW_BUF_SPANS);
+    ASSERT_EQ(hl[150], HL_COMMENT);
+    hl[150] = HL_MATCH;
+    ASSERT_EQ(editor_row_hl_at(row, 150), HL_MATCH);
+
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Highlight Spans")
+    RUN_TEST(hl_runs_are_counted_and_encoded);
+    RUN_TEST(hl_span_blocks_round_trip);
+    RUN_TEST(hl_spans_grow_past_inline_capacity);
+    RUN_TEST(rows_pack_highlight_and_unpack_to_write);
+END_TEST_SUITE()
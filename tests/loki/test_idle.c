@@ -0,0 +1,150 @@
+/* test_idle.c - Unit tests for idle tasks
+ *
+ * Tests for:
+ * - Steps called until they are done, and 'done' called once
+ * - Tasks taking turns, and a pass keeping to its budget
+ * - Cancelling a task, or all of an owner's
+ * - Steps adding and cancelling tasks, their own included
+ * - What a pass gets before the next frame
+ */
+
+#include "test_framework.h"
+#include "idle.h"
+#include <uv.h>
+
+typedef struct Counter {
+    int steps;                  /* Step calls */
+    int left;                   /* Steps before it is done */
+    int done;                   /* 'done' calls */
+    int damage;                 /* Return IDLE_DAMAGE with the last step */
+} Counter;
+
+static int count_step(void *arg, uint64_t deadline) {
+    (void)deadline;
+    Counter *c = arg;
+    c->steps++;
+    if (--c->left > 0) return IDLE_MORE;
+    return c->damage ? IDLE_DONE | IDLE_DAMAGE : IDLE_DONE;
+}
+
+static void count_done(void *arg) {
+    ((Counter *)arg)->done++;
+}
+
+TEST(steps_run_until_done) {
+    Counter a = {0, 3, 0, 0}, b = {0, 1, 0, 1};
+    int one = idle_add(&a, count_step, count_done, &a);
+    int two = idle_add(&b, count_step, count_done, &b);
+    ASSERT_TRUE(one > 0 && two > one);
+    ASSERT_EQ(idle_pending(), 2);
+
+    ASSERT_EQ(idle_run(0), 0);          /* No budget, no steps */
+    ASSERT_EQ(a.steps, 0);
+    ASSERT_EQ(idle_run(100000000), 1);  /* b's last step damaged */
+    ASSERT_EQ(a.steps, 3);
+    ASSERT_EQ(b.steps, 1);
+    ASSERT_EQ(a.done, 1);
+    ASSERT_EQ(b.done, 1);
+    ASSERT_EQ(idle_pending(), 0);
+    ASSERT_EQ(idle_cancel(one), 0);     /* Finished already */
+}
+
+static int order[8], norder;
+
+/* Spend the whole pass, noting who ran */
+static int hog_step(void *arg, uint64_t deadline) {
+    if (norder < 8) order[norder++] = (int)(intptr_t)arg;
+    while (uv_hrtime() < deadline)
+        ;
+    return IDLE_MORE;
+}
+
+TEST(tasks_take_turns_within_budget) {
+    norder = 0;
+    int one = idle_add(NULL, hog_step, NULL, (void *)1);
+    int two = idle_add(NULL, hog_step, NULL, (void *)2);
+    for (int i = 0; i < 4; i++) {
+        uint64_t start = uv_hrtime();
+        idle_run(1000000);
+        uint64_t took = uv_hrtime() - start;
+        ASSERT_TRUE(took >= 1000000);
+        ASSERT_TRUE(took < 20000000);
+    }
+    ASSERT_EQ(norder, 4);
+    ASSERT_EQ(order[0], 1);
+    ASSERT_EQ(order[1], 2);
+    ASSERT_EQ(order[2], 1);
+    ASSERT_EQ(order[3], 2);
+    ASSERT_EQ(idle_cancel(one), 1);
+    ASSERT_EQ(idle_cancel(two), 1);
+    ASSERT_EQ(idle_pending(), 0);
+}
+
+TEST(cancel_calls_done_once) {
+    Counter a = {0, 100, 0, 0}, b = {0, 100, 0, 0}, c = {0, 100, 0, 0};
+    static const int owner;
+    int one = idle_add(&owner, count_step, count_done, &a);
+    idle_add(&owner, count_step, count_done, &b);
+    idle_add(NULL, count_step, count_done, &c);
+
+    ASSERT_EQ(idle_cancel(one), 1);
+    ASSERT_EQ(a.done, 1);
+    ASSERT_EQ(idle_cancel(one), 0);
+    ASSERT_EQ(a.done, 1);
+
+    idle_cancel_owner(&owner);
+    ASSERT_EQ(b.done, 1);
+    ASSERT_EQ(c.done, 0);
+    ASSERT_EQ(idle_pending(), 1);
+
+    idle_cancel_owner(NULL);
+    ASSERT_EQ(c.done, 1);
+    ASSERT_EQ(idle_pending(), 0);
+    ASSERT_EQ(a.steps + b.steps + c.steps, 0);
+}
+
+static Counter child;
+static int self_id, self_steps, self_done_seen_steps;
+
+/* Adds a task, then cancels itself on its second step */
+static int spawning_step(void *arg, uint64_t deadline) {
+    (void)arg;
+    (void)deadline;
+    if (++self_steps == 1) {
+        child.left = 1;
+        idle_add(NULL, count_step, count_done, &child);
+        return IDLE_MORE;
+    }
+    idle_cancel(self_id);
+    return IDLE_MORE;
+}
+
+static void spawning_done(void *arg) {
+    (void)arg;
+    self_done_seen_steps = self_steps;
+}
+
+TEST(steps_add_and_cancel_tasks) {
+    self_id = idle_add(NULL, spawning_step, spawning_done, NULL);
+    idle_run(100000000);
+    ASSERT_EQ(self_steps, 2);
+    ASSERT_EQ(self_done_seen_steps, 2);  /* After its last step returned */
+    ASSERT_EQ(child.steps, 1);
+    ASSERT_EQ(child.done, 1);
+    ASSERT_EQ(idle_pending(), 0);
+}
+
+TEST(budget_before_next_frame) {
+    ASSERT_EQ(idle_budget(0), 0);
+    ASSERT_EQ(idle_budget(2), 1000000);
+    ASSERT_EQ(idle_budget(100), IDLE_FRAME_BUDGET_NS);
+    ASSERT_EQ(idle_budget(-1), IDLE_FRAME_BUDGET_NS);
+}
+
+BEGIN_TEST_SUITE("Idle Tasks")
+    RUN_TEST(steps_run_until_done);
+    RUN_TEST(tasks_take_turns_within_budget);
+    RUN_TEST(cancel_calls_done_once);
+    RUN_TEST(steps_add_and_cancel_tasks);
+    RUN_TEST(budget_before_next_frame);
+END_TEST_SUITE()
@@ -2,10 +2,12 @@
  *
  * Tests all aspects of auto-indentation:
  * - Indentation level detection
- * - Style detection (tabs vs spaces)
+ * - Style detection (tabs vs spaces), and width detection sampled over
+ *   the whole file
  * - Auto-indent on newline
  * - Electric dedent for closing braces
  * - Configuration
+ * - Reindenting the buffer, or a range, as one undo step
  */
 
 #include <stdio.h>
@@ -14,6 +16,8 @@
 #include "loki/core.h"
 #include "internal.h"
 #include "indent.h"
+#include "syntax.h"
+#include "undo.h"
 #include "test_framework.h"
 
 /* Helper: Create editor context with test content */
@@ -487,6 +491,125 @@ TEST(indent_electric_mismatched_brackets) {
     free_test_ctx(ctx);
 }
 
+/* Test: indent_detect() finds the width from steps between lines */
+TEST(indent_detect_width) {
+    editor_ctx_t *ctx = create_test_ctx();
+
+    insert_line(ctx, "a {");
+    insert_line(ctx, "  b {");
+    insert_line(ctx, "    c");
+    insert_line(ctx, "  }");
+    insert_line(ctx, "}");
+
+    int style, width;
+    ASSERT_TRUE(indent_detect(ctx, &style, &width));
+    ASSERT_EQ(style, INDENT_STYLE_SPACES);
+    ASSERT_EQ(width, 2);
+
+    indent_adopt_detected(ctx);
+    ASSERT_EQ(indent_get_width(ctx), 2);
+
+    free_test_ctx(ctx);
+}
+
+/* Test: indent_detect() samples all of a long file, not just its head */
+TEST(indent_detect_samples_whole_file) {
+    editor_ctx_t *ctx = create_test_ctx();
+
+    /* A long unindented head, then tab-indented code */
+    for (int i = 0; i < 5000; i++) insert_line(ctx, "// header");
+    for (int i = 0; i < 20000; i++) insert_line(ctx, i % 2 ? "\tx;" : "f() {");
+
+    int style, width;
+    ASSERT_TRUE(indent_detect(ctx, &style, &width));
+    ASSERT_EQ(style, INDENT_STYLE_TABS);
+
+    /* Nothing indented: nothing adopted */
+    editor_ctx_t *flat = create_test_ctx();
+    insert_line(flat, "one");
+    insert_line(flat, "two");
+    ASSERT_FALSE(indent_detect(flat, &style, &width));
+    indent_set_width(flat, 3);
+    indent_adopt_detected(flat);
+    ASSERT_EQ(indent_get_width(flat), 3);
+
+    free_test_ctx(flat);
+    free_test_ctx(ctx);
+}
+
+/* Test: indent_reindent() fixes only the lines that are off, in one undo */
+TEST(indent_reindent_buffer) {
+    editor_ctx_t *ctx = create_test_ctx();
+
+    insert_line(ctx, "int f(void) {");
+    insert_line(ctx, "if (x) {");
+    insert_line(ctx, "  call(1,");
+    insert_line(ctx, "2);");
+    insert_line(ctx, "        }");
+    insert_line(ctx, "    return \"}\";   ");
+    insert_line(ctx, "  ");
+    insert_line(ctx, "}");
+
+    ASSERT_EQ(indent_reindent(ctx, 0, ctx->model.numrows - 1), 5);
+    ASSERT_STR_EQ(ctx->model.row[0].chars, "int f(void) {");
+    ASSERT_STR_EQ(ctx->model.row[1].chars, "    if (x) {");
+    ASSERT_STR_EQ(ctx->model.row[2].chars, "        call(1,");
+    ASSERT_STR_EQ(ctx->model.row[3].chars, "            2);");
+    ASSERT_STR_EQ(ctx->model.row[4].chars, "    }");
+    ASSERT_STR_EQ(ctx->model.row[5].chars, "    return \"}\";   ");
+    ASSERT_STR_EQ(ctx->model.row[6].chars, "");
+    ASSERT_STR_EQ(ctx->model.row[7].chars, "}");
+
+    /* Already right: nothing to do */
+    ASSERT_EQ(indent_reindent(ctx, 0, ctx->model.numrows - 1), 0);
+
+    ASSERT_EQ(undo_perform(ctx), 1);
+    ASSERT_STR_EQ(ctx->model.row[1].chars, "if (x) {");
+    ASSERT_STR_EQ(ctx->model.row[4].chars, "        }");
+    ASSERT_FALSE(undo_can_undo(ctx));
+
+    free_test_ctx(ctx);
+}
+
+/* Test: indent_reindent() of a range, with tabs, knows the brackets above it */
+TEST(indent_reindent_range_with_tabs) {
+    editor_ctx_t *ctx = create_test_ctx();
+    indent_set_style(ctx, INDENT_STYLE_TABS);
+
+    insert_line(ctx, "void g() {");
+    insert_line(ctx, "\twhile (1) {");
+    insert_line(ctx, "a();");
+    insert_line(ctx, "  b();");
+    insert_line(ctx, "}");
+
+    ASSERT_EQ(indent_reindent(ctx, 2, 2), 1);
+    ASSERT_STR_EQ(ctx->model.row[2].chars, "\t\ta();");
+    ASSERT_STR_EQ(ctx->model.row[3].chars, "  b();");    /* Outside the range */
+
+    free_test_ctx(ctx);
+}
+
+/* Test: indent_reindent() keeps lines outside brackets and in comments */
+TEST(indent_reindent_keeps_unbracketed_and_comments) {
+    editor_ctx_t *ctx = create_test_ctx();
+    syntax_select_for_filename(ctx, "test.c");
+
+    insert_line(ctx, "def f():");
+    insert_line(ctx, "  return 1");
+    insert_line(ctx, "x = {  /* {");
+    insert_line(ctx, "      keep } */");
+    insert_line(ctx, "a, // {");
+    insert_line(ctx, "}");
+
+    ASSERT_EQ(indent_reindent(ctx, 0, ctx->model.numrows - 1), 1);
+    ASSERT_STR_EQ(ctx->model.row[1].chars, "  return 1");
+    ASSERT_STR_EQ(ctx->model.row[3].chars, "      keep } */");
+    ASSERT_STR_EQ(ctx->model.row[4].chars, "    a, // {");
+    ASSERT_STR_EQ(ctx->model.row[5].chars, "}");
+
+    free_test_ctx(ctx);
+}
+
 /* Test suite runner */
 BEGIN_TEST_SUITE("Auto-Indent Module")
 
@@ -525,4 +648,11 @@ BEGIN_TEST_SUITE("Auto-Indent Module")
     RUN_TEST(indent_electric_nested_braces);
     RUN_TEST(indent_electric_mismatched_brackets);
 
+    /* indent_detect() and indent_reindent() tests */
+    RUN_TEST(indent_detect_width);
+    RUN_TEST(indent_detect_samples_whole_file);
+    RUN_TEST(indent_reindent_buffer);
+    RUN_TEST(indent_reindent_range_with_tabs);
+    RUN_TEST(indent_reindent_keeps_unbracketed_and_comments);
+
 END_TEST_SUITE()
@@ -0,0 +1,221 @@
+/* test_job.c - Unit tests for background jobs
+ *
+ * Tests for:
+ * - Output of stdout and stderr delivered through the queue, then the
+ *   exit status
+ * - Large output in chunks of at most JOB_CHUNK_MAX, reading stopped
+ *   while the queue is not drained
+ * - Output added to a buffer, lines written in parts completed on their
+ *   row and the view kept to the end
+ * - Idle jobs left alone by job_tick(), and stopped jobs ending by signal
+ */
+
+#include "test_framework.h"
+#include "job.h"
+#include "internal.h"
+#include "buffers.h"
+#include "async_queue.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+/* What the jobs delivered */
+static char out_text[1 << 16], err_text[256];
+static size_t out_len, err_len, out_total, biggest;
+static int chunks, exits, last_exit_id, last_signal;
+static int64_t last_status;
+
+static void reset(void) {
+    out_len = err_len = out_total = biggest = 0;
+    chunks = exits = last_exit_id = last_signal = 0;
+    last_status = -1;
+}
+
+static void on_output(editor_ctx_t *ctx, int id, int stream, const char *data,
+                      size_t len, void *opaque) {
+    (void)ctx; (void)id; (void)opaque;
+    chunks++;
+    if (len > biggest) biggest = len;
+    ASSERT_TRUE(data[len] == '\0');
+    if (stream == JOB_EVENT_STDOUT) {
+        out_total += len;
+        if (out_len + len < sizeof(out_text)) {
+            memcpy(out_text + out_len, data, len);
+            out_len += len;
+        }
+    } else if (err_len + len < sizeof(err_text)) {
+        memcpy(err_text + err_len, data, len);
+        err_len += len;
+    }
+}
+
+static void on_exit_fn(editor_ctx_t *ctx, int id, int64_t status, int term_signal,
+                       void *opaque) {
+    (void)ctx; (void)opaque;
+    exits++;
+    last_exit_id = id;
+    last_status = status;
+    last_signal = term_signal;
+}
+
+static int start(const char *cmd, int buffer_id) {
+    JobSpec spec = { cmd, NULL, buffer_id, on_output, on_exit_fn, NULL };
+    const char *error = NULL;
+    return job_start(&spec, &error);
+}
+
+/* Run the loop, as the editor does, until 'n' jobs have exited, for ten
+ * seconds at most */
+static void wait_exits(editor_ctx_t *ctx, int n) {
+    uint64_t until = uv_hrtime() + (uint64_t)10 * 1000000000;
+    while (exits < n && uv_hrtime() < until) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        job_tick();
+        async_queue_dispatch_all(NULL, ctx);
+    }
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);   /* Close the handles */
+}
+
+TEST(job_streams_output_and_exit) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    reset();
+
+    int id = start("printf 'a\\nb\\n'; echo err >&2; exit 4", -1);
+    ASSERT_TRUE(id > 0);
+    ASSERT_EQ(job_count(), 1);
+    wait_exits(&ctx, 1);
+    ASSERT_EQ(exits, 1);
+    ASSERT_EQ(last_exit_id, id);
+    ASSERT_EQ((int)last_status, 4);
+    ASSERT_EQ(last_signal, 0);
+    out_text[out_len] = '\0';
+    err_text[err_len] = '\0';
+    ASSERT_STR_EQ(out_text, "a\nb\n");
+    ASSERT_STR_EQ(err_text, "err\n");
+    ASSERT_EQ(job_count(), 0);
+    ASSERT_EQ(job_stop(id), -1);
+
+    /* A directory to run in */
+    reset();
+    JobSpec spec = { "pwd", "/", -1, on_output, on_exit_fn, NULL };
+    const char *error = NULL;
+    ASSERT_TRUE(job_start(&spec, &error) > 0);
+    wait_exits(&ctx, 1);
+    out_text[out_len] = '\0';
+    ASSERT_STR_EQ(out_text, "/\n");
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+}
+
+TEST(job_output_in_chunks_with_backpressure) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    reset();
+
+    size_t total = (size_t)3 * JOB_QUEUED_MAX;
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "head -c %zu /dev/zero", total);
+    ASSERT_TRUE(start(cmd, -1) > 0);
+
+    /* Nothing handled: reading stops with a few MB queued */
+    uint64_t until = uv_hrtime() + (uint64_t)500 * 1000000;
+    while (uv_hrtime() < until) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        job_tick();
+    }
+    ASSERT_TRUE(async_queue_count(NULL) > 0);
+    async_queue_dispatch_all(NULL, &ctx);
+    ASSERT_TRUE(out_total >= JOB_QUEUED_MAX);
+    ASSERT_TRUE(out_total <= JOB_QUEUED_MAX + 2 * JOB_CHUNK_MAX);
+    ASSERT_EQ(exits, 0);
+
+    /* Handled, it all comes */
+    wait_exits(&ctx, 1);
+    ASSERT_EQ(exits, 1);
+    ASSERT_EQ((int)last_status, 0);
+    ASSERT_TRUE(out_total == total);
+    ASSERT_TRUE(biggest <= JOB_CHUNK_MAX);
+    ASSERT_TRUE((size_t)chunks >= total / JOB_CHUNK_MAX);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+}
+
+TEST(job_output_to_buffer) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 2;
+    ctx.view.screencols = 80;
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    reset();
+
+    int id = buffer_create(NULL);
+    ASSERT_TRUE(id >= 0);
+    ASSERT_TRUE(start("printf 'one\\ntw'; sleep 0.2; printf 'o\\nthree\\nfour\\n'", id) > 0);
+    wait_exits(&ctx, 1);
+    editor_ctx_t *buf = buffer_get(id);
+    ASSERT_NOT_NULL(buf);
+    ASSERT_EQ(buf->model.numrows, 4);
+    ASSERT_STR_EQ(buf->model.row[0].chars, "one");
+    ASSERT_STR_EQ(buf->model.row[1].chars, "two");
+    ASSERT_STR_EQ(buf->model.row[3].chars, "four");
+    ASSERT_EQ(buf->view.rowoff + buf->view.cy, 3);
+    ASSERT_EQ(buf->model.dirty, 0);
+    ASSERT_TRUE(strstr(buf->view.statusmsg, "exit 0") != NULL);
+
+    /* A buffer closed under the job: its output goes nowhere */
+    ASSERT_TRUE(start("sleep 0.1; echo late", id) > 0);
+    buffer_close(id, 1);
+    wait_exits(&ctx, 2);
+    ASSERT_EQ(exits, 2);
+
+    buffers_free();
+    async_queue_cleanup();
+}
+
+TEST(idle_jobs_cost_nothing) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    reset();
+
+    int ids[50];
+    for (int i = 0; i < 50; i++) {
+        ids[i] = start("sleep 5", -1);
+        ASSERT_TRUE(ids[i] > 0);
+    }
+    ASSERT_EQ(job_count(), 50);
+    for (int i = 0; i < 20; i++) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        ASSERT_EQ(job_tick(), -1);
+    }
+    ASSERT_TRUE(async_queue_is_empty(NULL));
+
+    for (int i = 0; i < 50; i++) ASSERT_EQ(job_stop(ids[i]), 0);
+    wait_exits(&ctx, 50);
+    ASSERT_EQ(exits, 50);
+    ASSERT_EQ(last_signal, SIGTERM);
+    ASSERT_EQ(job_count(), 0);
+
+    /* At exit, the running ones are killed without their events */
+    ASSERT_TRUE(start("sleep 5", -1) > 0);
+    job_stop_all();
+    ASSERT_EQ(job_count(), 0);
+    for (int i = 0; i < 20; i++) uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("job")
+    RUN_TEST(job_streams_output_and_exit);
+    RUN_TEST(job_output_in_chunks_with_backpressure);
+    RUN_TEST(job_output_to_buffer);
+    RUN_TEST(idle_jobs_cost_nothing);
+END_TEST_SUITE()
@@ -0,0 +1,283 @@
+/* test_json.c - Unit tests for the JSON-RPC parser
+ *
+ * Tests for:
+ * - Parsing commands, nested values and escapes
+ * - Strings decoded in place, in the caller's text
+ * - Hashed lookup in objects of many keys, duplicates included
+ * - Rejection of malformed and too deeply nested input
+ * - MessagePack written by the builder, long strings by reference, and
+ *   read back into the same values
+ * - Escapes anywhere in long strings, integers at their limits, and
+ *   output written into the room reserved for it
+ */
+
+#include "test_framework.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+TEST(json_parses_command) {
+    const char *text = "{\"cmd\": \"load\", \"code\": -105, \"on\": true, \"off\": false, "
+                       "\"none\": null, \"list\": [1, [2, 3], {}], \"f\": 1.5e3}";
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, text, strlen(text)), 0);
+    ASSERT_EQ(doc.root.type, JSON_OBJECT);
+    ASSERT_STR_EQ(json_object_get_string(&doc.root, "cmd"), "load");
+    ASSERT_EQ(json_object_get_int(&doc.root, "code", 0), -105);
+    ASSERT_EQ(json_object_get_bool(&doc.root, "on", 0), 1);
+    ASSERT_EQ(json_object_get_bool(&doc.root, "off", 1), 0);
+    ASSERT_EQ(json_object_get(&doc.root, "none")->type, JSON_NULL);
+    ASSERT_EQ(json_object_get_int(&doc.root, "f", 0), 1);
+    ASSERT_NULL(json_object_get_string(&doc.root, "code"));
+    ASSERT_EQ(json_object_get_int(&doc.root, "missing", 7), 7);
+
+    const JsonValue *list = json_object_get(&doc.root, "list");
+    ASSERT_EQ(list->type, JSON_ARRAY);
+    ASSERT_EQ((int)list->data.array_val.count, 3);
+    ASSERT_EQ(list->data.array_val.items[1].data.array_val.items[1].data.int_val, 3);
+    ASSERT_EQ((int)list->data.array_val.items[2].data.object_val.count, 0);
+    json_doc_free(&doc);
+}
+
+TEST(json_decodes_strings_in_place) {
+    char text[] = "{\"plain\": \"abc\", \"esc\": \"a\\\"b\\\\c\\nd\\u0041\"}";
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse_insitu(&doc, text, strlen(text)), 0);
+    const JsonValue *plain = json_object_get(&doc.root, "plain");
+    ASSERT_TRUE(plain->data.string_val.str > text);
+    ASSERT_TRUE(plain->data.string_val.str < text + sizeof(text));
+    ASSERT_STR_EQ(plain->data.string_val.str, "abc");
+    const JsonValue *esc = json_object_get(&doc.root, "esc");
+    ASSERT_STR_EQ(esc->data.string_val.str, "a\"b\\c\nd?");
+    ASSERT_EQ((int)esc->data.string_val.len, 8);
+    json_doc_free(&doc);
+}
+
+TEST(json_indexes_large_objects) {
+    char text[8192], key[32];
+    size_t len = 0;
+    text[len++] = '{';
+    for (int i = 0; i < 200; i++)
+        len += (size_t)snprintf(text + len, sizeof(text) - len, "%s\"key%d\": %d",
+                                i ? ", " : "", i, i * 2);
+    len += (size_t)snprintf(text + len, sizeof(text) - len, ", \"key5\": -1}");
+
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, text, len), 0);
+    ASSERT_NULL(doc.root.data.object_val.index);
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        ASSERT_EQ(json_object_get_int(&doc.root, key, -2), i * 2);
+    }
+    ASSERT_NOT_NULL(doc.root.data.object_val.index);
+    ASSERT_EQ(json_object_get_int(&doc.root, "key5", 0), 10);     /* The first */
+    ASSERT_NULL(json_object_get(&doc.root, "key200"));
+    json_doc_free(&doc);
+}
+
+TEST(json_rejects_malformed_input) {
+    const char *bad[] = {
+        "", "{", "{\"a\" 1}", "{\"a\": }", "[1, 2", "[1 2]", "\"open", "tru",
+        "{\"a\": 1,}", "\"\\u12\""
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        JsonDoc doc;
+        ASSERT_EQ(json_doc_parse(&doc, bad[i], strlen(bad[i])), -1);
+        ASSERT_EQ(doc.root.type, JSON_ERROR);
+        json_doc_free(&doc);
+    }
+
+    char deep[2048];
+    memset(deep, '[', sizeof(deep));
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, deep, sizeof(deep)), -1);
+    json_doc_free(&doc);
+}
+
+TEST(json_msgpack_round_trip) {
+    char long_text[300];
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+
+    JsonBuilder jb;
+    json_builder_init_msgpack(&jb);
+    json_object_start(&jb);
+    json_kv_string(&jb, "cmd", "load");
+    json_kv_int(&jb, "small", -5);
+    json_kv_int(&jb, "byte", -100);
+    json_kv_int(&jb, "short", 300);
+    json_kv_int(&jb, "int", -70000);
+    json_kv_bool(&jb, "on", 1);
+    json_kv_double(&jb, "f", 2.75);
+    json_key(&jb, "none");
+    json_null(&jb);
+    json_key(&jb, "long");
+    json_string_ref(&jb, long_text, strlen(long_text));
+    json_key(&jb, "list");
+    json_array_start(&jb);
+    for (int i = 0; i < 20; i++) json_int(&jb, i * 1000);
+    json_array_end(&jb);
+    json_object_end(&jb);
+    ASSERT_FALSE(jb.error);
+
+    /* The long string is kept apart, so the map it is in keeps its
+     * 32-bit count; the array before it was shortened */
+    ASSERT_EQ((int)jb.ref_count, 1);
+    ASSERT_EQ((unsigned char)jb.buf[0], 0xdf);
+    struct iovec iov[4];
+    ASSERT_EQ(json_builder_iov(&jb, iov, 4), 3);
+    ASSERT_TRUE(iov[1].iov_base == long_text);
+
+    size_t len;
+    char *data = json_builder_flatten(&jb, &len);
+    ASSERT_NOT_NULL(data);
+    ASSERT_EQ((int)len, (int)json_builder_size(&jb));
+    json_builder_free(&jb);
+
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse_msgpack(&doc, data, len), 0);
+    ASSERT_EQ(doc.root.type, JSON_OBJECT);
+    ASSERT_STR_EQ(json_object_get_string(&doc.root, "cmd"), "load");
+    ASSERT_EQ(json_object_get_int(&doc.root, "small", 0), -5);
+    ASSERT_EQ(json_object_get_int(&doc.root, "byte", 0), -100);
+    ASSERT_EQ(json_object_get_int(&doc.root, "short", 0), 300);
+    ASSERT_EQ(json_object_get_int(&doc.root, "int", 0), -70000);
+    ASSERT_EQ(json_object_get_bool(&doc.root, "on", 0), 1);
+    ASSERT_EQ(json_object_get_int(&doc.root, "f", 0), 2);
+    ASSERT_EQ(json_object_get(&doc.root, "none")->type, JSON_NULL);
+    ASSERT_STR_EQ(json_object_get_string(&doc.root, "long"), long_text);
+    const JsonValue *list = json_object_get(&doc.root, "list");
+    ASSERT_EQ((int)list->data.array_val.count, 20);
+    ASSERT_EQ(list->data.array_val.items[19].data.int_val, 19000);
+    json_doc_free(&doc);
+    free(data);
+
+    /* Without references, every count is in as few bytes as it takes */
+    json_builder_init_msgpack(&jb);
+    json_object_start(&jb);
+    json_kv_int(&jb, "a", 1);
+    json_object_end(&jb);
+    ASSERT_EQ((int)jb.len, 4);
+    ASSERT_EQ(memcmp(jb.buf, "\x81\xa1" "a\x01", 4), 0);
+    json_builder_free(&jb);
+}
+
+TEST(json_msgpack_rejects_malformed_input) {
+    static const struct { const char *data; size_t len; } bad[] = {
+        { "", 0 },
+        { "\x82\xa1" "a\x01", 4 },            /* A member short */
+        { "\x81\x01\x01", 3 },                /* A key that is not a string */
+        { "\xa5" "abc", 4 },                   /* A string short */
+        { "\xdd\xff\xff\xff\xff\x01", 6 },    /* A count past the data */
+        { "\xd4\x01\x02", 3 },                /* An extension */
+        { "\xc1", 1 },
+        { "\x01\x02", 2 },                    /* A second value */
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        JsonDoc doc;
+        ASSERT_EQ(json_doc_parse_msgpack(&doc, bad[i].data, bad[i].len), -1);
+        json_doc_free(&doc);
+    }
+
+    char deep[2048];
+    memset(deep, '\x91', sizeof(deep));
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse_msgpack(&doc, deep, sizeof(deep)), -1);
+    json_doc_free(&doc);
+}
+
+/* Helper: 's' escaped the slow way, quotes included */
+static void escape_slowly(char *out, const char *s, size_t len) {
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c == '\n') {
+            out += sprintf(out, "\\n");
+        } else if (c == '\t') {
+            out += sprintf(out, "\\t");
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    *out = '\0';
+}
+
+TEST(json_escapes_anywhere_in_long_strings) {
+    const char specials[] = { '"', '\\', '\n', '\t', '\x01', '\x1f' };
+    char text[80], expect[512];
+    for (size_t at = 0; at < 40; at++) {
+        for (size_t k = 0; k < sizeof(specials); k++) {
+            /* Plain text, some of it UTF-8, and one special at 'at' */
+            snprintf(text, sizeof(text), "plain text \xd0\xb8\xd0\xb3 and some more of it");
+            size_t len = strlen(text);
+            text[at % len] = specials[k];
+            escape_slowly(expect, text, len);
+
+            JsonBuilder jb;
+            json_builder_init(&jb);
+            json_string_len(&jb, text, len);
+            ASSERT_STR_EQ(json_builder_get(&jb), expect);
+            json_builder_free(&jb);
+        }
+    }
+
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_string(&jb, "\"\\\b\f\r\x7f");
+    ASSERT_STR_EQ(json_builder_get(&jb), "\"\\\"\\\\\\b\\f\\r\x7f\"");
+    json_builder_free(&jb);
+}
+
+TEST(json_writes_integers) {
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    json_array_start(&jb);
+    const int values[] = { 0, 7, -7, 10, 99, 100, -100, 12345, INT_MAX, INT_MIN };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        json_int(&jb, values[i]);
+    json_array_end(&jb);
+    char expect[256];
+    snprintf(expect, sizeof(expect), "[0,7,-7,10,99,100,-100,12345,%d,%d]", INT_MAX, INT_MIN);
+    ASSERT_STR_EQ(json_builder_get(&jb), expect);
+    json_builder_free(&jb);
+}
+
+TEST(json_builder_writes_into_reserved_room) {
+    JsonBuilder jb;
+    json_builder_init(&jb);
+    ASSERT_STR_EQ(json_builder_get(&jb), "");
+    json_builder_reserve(&jb, 10000);
+    const char *buf = jb.buf;
+    json_array_start(&jb);
+    for (int i = 0; i < 500; i++) json_string(&jb, "twelve chars");
+    json_array_end(&jb);
+    ASSERT_TRUE(jb.buf == buf);     /* Not moved: nothing was allocated */
+    ASSERT_EQ((int)jb.len, 500 * 15 + 1);
+
+    char *out = json_builder_take(&jb);
+    ASSERT_TRUE(out == buf);
+    ASSERT_NULL(jb.buf);
+    ASSERT_EQ(strncmp(out, "[\"twelve chars\",", 16), 0);
+    free(out);
+    json_builder_free(&jb);
+}
+
+BEGIN_TEST_SUITE("JSON Parser")
+    RUN_TEST(json_parses_command);
+    RUN_TEST(json_decodes_strings_in_place);
+    RUN_TEST(json_indexes_large_objects);
+    RUN_TEST(json_rejects_malformed_input);
+    RUN_TEST(json_msgpack_round_trip);
+    RUN_TEST(json_msgpack_rejects_malformed_input);
+    RUN_TEST(json_escapes_anywhere_in_long_strings);
+    RUN_TEST(json_writes_integers);
+    RUN_TEST(json_builder_writes_into_reserved_room);
+END_TEST_SUITE()
@@ -0,0 +1,173 @@
+/* test_json_stream.c - Unit tests for the push JSON parser
+ *
+ * Tests for:
+ * - The same events whatever pieces the text comes in
+ * - Escapes, \u escapes and surrogate pairs
+ * - Picking a field out of a large document, skipping the rest
+ * - Captured values, parsed with json_doc_parse()
+ * - Rejection of malformed input
+ */
+
+#include "test_framework.h"
+#include "json_stream.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Helper: The events of a stream, written out one after another */
+typedef struct {
+    char log[4096];
+    size_t len;
+    const char *skip_at;        /* Skip the value at this path */
+    const char *capture_at;     /* Capture the value at this path */
+    const char *want;           /* Path of the string wanted */
+    char found[64];
+    int events;
+} Recorder;
+
+static const char *const event_names[] = {
+    "{", "}", "[", "]", "key:", "str:", "num:", "true", "false", "null", "value:"
+};
+
+static int record(void *opaque, JsonStream *s, JsonEvent ev, const char *text, size_t len) {
+    Recorder *r = opaque;
+    r->events++;
+    if ((ev == JSON_EV_OBJECT_START || ev == JSON_EV_ARRAY_START) && r->skip_at &&
+        json_stream_at(s, r->skip_at))
+        json_stream_skip(s);
+    if ((ev == JSON_EV_OBJECT_START || ev == JSON_EV_ARRAY_START) && r->capture_at &&
+        json_stream_at(s, r->capture_at))
+        json_stream_capture(s);
+    if (ev == JSON_EV_STRING && r->want && json_stream_at(s, r->want)) {
+        snprintf(r->found, sizeof(r->found), "%s", text);
+        return 1;
+    }
+    r->len += (size_t)snprintf(r->log + r->len, sizeof(r->log) - r->len, "%s%s ",
+                               event_names[ev], (ev >= JSON_EV_KEY && ev <= JSON_EV_NUMBER) ||
+                               ev == JSON_EV_VALUE ? text : "");
+    (void)len;
+    return 0;
+}
+
+/* Helper: Feed 'text' in pieces of 'step' bytes; returns the last result */
+static int feed_in_pieces(JsonStream *s, const char *text, size_t step) {
+    size_t len = strlen(text);
+    int rc = 0;
+    for (size_t i = 0; i < len && rc == 0; i += step)
+        rc = json_stream_feed(s, text + i, len - i < step ? len - i : step);
+    return rc;
+}
+
+TEST(json_stream_pieces_do_not_matter) {
+    const char *text = "{\"name\": \"lo\\\"ki\", \"n\": [1, -2.5e3, {}], \"ok\": true, "
+                       "\"no\": false, \"nil\": null, \"deep\": {\"a\": [[]]}} 42 \"next\"";
+    Recorder whole;
+    memset(&whole, 0, sizeof(whole));
+    JsonStream *s = json_stream_new(record, &whole);
+    ASSERT_EQ(json_stream_feed(s, text, strlen(text)), 0);
+    ASSERT_EQ(json_stream_finish(s), 0);
+    ASSERT_STR_EQ(whole.log, "{ key:name str:lo\"ki key:n [ num:1 num:-2.5e3 { } ] key:ok true "
+                             "key:no false key:nil null key:deep { key:a [ [ ] ] } } num:42 "
+                             "str:next ");
+    json_stream_free(s);
+
+    for (size_t step = 1; step < 8; step++) {
+        Recorder r;
+        memset(&r, 0, sizeof(r));
+        s = json_stream_new(record, &r);
+        ASSERT_EQ(feed_in_pieces(s, text, step), 0);
+        ASSERT_EQ(json_stream_finish(s), 0);
+        ASSERT_STR_EQ(r.log, whole.log);
+        json_stream_free(s);
+    }
+}
+
+TEST(json_stream_decodes_escapes) {
+    Recorder r;
+    memset(&r, 0, sizeof(r));
+    JsonStream *s = json_stream_new(record, &r);
+    const char *text = "[\"a\\tb\\/\\u00e9\\u20AC\\ud83d\\ude00\", \"\\ud800x\"]";
+    ASSERT_EQ(feed_in_pieces(s, text, 3), 0);
+    ASSERT_STR_EQ(r.log, "[ str:a\tb/\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80 "
+                         "str:\xEF\xBF\xBDx ] ");
+    ASSERT_TRUE(json_stream_idle(s));
+    json_stream_free(s);
+}
+
+TEST(json_stream_picks_a_field) {
+    /* A megabyte of values with brackets and quotes in their strings */
+    size_t cap = 1200 * 1024, len = 0;
+    char *text = malloc(cap);
+    len += (size_t)snprintf(text + len, cap - len, "{\"result\": {\"items\": [");
+    for (int i = 0; len < 1024 * 1024; i++)
+        len += (size_t)snprintf(text + len, cap - len,
+                                "%s{\"id\": %d, \"text\": \"[not} \\\"a{ bracket\\\\\"}",
+                                i ? ", " : "", i);
+    len += (size_t)snprintf(text + len, cap - len, "], \"name\": \"found\"}}");
+
+    Recorder r;
+    memset(&r, 0, sizeof(r));
+    r.skip_at = "result.items";
+    r.want = "result.name";
+    JsonStream *s = json_stream_new(record, &r);
+    ASSERT_EQ(feed_in_pieces(s, text, 4096), 1);     /* Stopped once found */
+    ASSERT_STR_EQ(r.found, "found");
+    ASSERT_EQ(r.events, 7);     /* The items array skipped whole */
+    json_stream_free(s);
+    free(text);
+}
+
+TEST(json_stream_captures_values) {
+    Recorder r;
+    memset(&r, 0, sizeof(r));
+    r.capture_at = "params.1";
+    JsonStream *s = json_stream_new(record, &r);
+    const char *text = "{\"params\": [0, {\"cmd\": \"load\", \"list\": [\"]\"]}, 2]}";
+    ASSERT_EQ(feed_in_pieces(s, text, 5), 0);
+    ASSERT_STR_EQ(r.log, "{ key:params [ num:0 { value:{\"cmd\": \"load\", \"list\": [\"]\"]} "
+                         "num:2 ] } ");
+
+    /* The text is a value of its own */
+    const char *value = strstr(r.log, "value:") + 6;
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, value, strlen(value)), 0);
+    ASSERT_STR_EQ(json_object_get_string(&doc.root, "cmd"), "load");
+    json_doc_free(&doc);
+    json_stream_free(s);
+}
+
+TEST(json_stream_rejects_malformed_input) {
+    const char *bad[] = {
+        "{\"a\" 1}", "[1 2]", "[1,]", "{\"a\": 1,}", "[}", "tru ", "01 ", "1. ", "-",
+        "\"\\x\"", "\"\\u12g4\"", "{1: 2}", "]"
+    };
+    Recorder r;
+    JsonStream *s = json_stream_new(record, &r);
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        memset(&r, 0, sizeof(r));
+        json_stream_reset(s);
+        int rc = json_stream_feed(s, bad[i], strlen(bad[i]));
+        if (rc == 0) rc = json_stream_finish(s);
+        ASSERT_EQ(rc, -1);
+    }
+
+    /* Stopped inside a value, and too deep */
+    json_stream_reset(s);
+    ASSERT_EQ(json_stream_feed(s, "{\"a\": [1", 8), 0);
+    ASSERT_FALSE(json_stream_idle(s));
+    ASSERT_EQ(json_stream_finish(s), -1);
+    char deep[JSON_STREAM_MAX_DEPTH + 1];
+    memset(deep, '[', sizeof(deep));
+    json_stream_reset(s);
+    ASSERT_EQ(json_stream_feed(s, deep, sizeof(deep)), -1);
+    json_stream_free(s);
+}
+
+BEGIN_TEST_SUITE("JSON Stream")
+    RUN_TEST(json_stream_pieces_do_not_matter);
+    RUN_TEST(json_stream_decodes_escapes);
+    RUN_TEST(json_stream_picks_a_field);
+    RUN_TEST(json_stream_captures_values);
+    RUN_TEST(json_stream_rejects_malformed_input);
+END_TEST_SUITE()
@@ -0,0 +1,319 @@
+/* test_jsonrpc.c - Unit tests for the JSON-RPC viewmodel serialization
+ *
+ * Tests for:
+ * - Whole viewmodels
+ * - Deltas of unchanged, edited and scrolled frames
+ * - Frames of other dimensions sent whole
+ * - Viewmodels in MessagePack, read back as the JSON ones are
+ * - Batches answered once, and commands asking for their frame
+ * - Frames filled again in the memory of the last
+ */
+
+#define _DEFAULT_SOURCE     /* fileno() */
+
+#include "test_framework.h"
+#include "jsonrpc.h"
+#include "session.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Helper: A session of 'lines' numbered lines, in normal mode at the top */
+static EditorSession *numbered_session(int lines) {
+    EditorConfig config = {0};
+    config.rows = 12;
+    config.cols = 40;
+    EditorSession *session = editor_session_new(&config);
+    EditorEvent ev = {0};
+    ev.type = EVENT_KEY;
+    ev.data.key.keycode = 'i';
+    editor_session_handle_event(session, &ev);
+    char line[32];
+    for (int i = 0; i < lines; i++) {
+        snprintf(line, sizeof(line), i ? "\rline %d" : "line %d", i);
+        for (const char *p = line; *p; p++) {
+            ev.data.key.keycode = (unsigned char)*p;
+            editor_session_handle_event(session, &ev);
+        }
+    }
+    ev.data.key.keycode = 27;   /* Escape, and back to the top */
+    editor_session_handle_event(session, &ev);
+    for (int i = 0; i < lines; i++) {
+        ev.data.key.keycode = 'k';
+        editor_session_handle_event(session, &ev);
+    }
+    ev.data.key.keycode = '0';
+    editor_session_handle_event(session, &ev);
+    return session;
+}
+
+static void send_key(EditorSession *session, int code) {
+    EditorEvent ev = {0};
+    ev.type = EVENT_KEY;
+    ev.data.key.keycode = code;
+    editor_session_handle_event(session, &ev);
+}
+
+/* Helper: The number of rows of a parsed delta */
+static size_t delta_rows(const JsonDoc *doc) {
+    const JsonValue *rows = json_object_get(&doc->root, "rows_content");
+    return rows ? rows->data.array_val.count : 0;
+}
+
+TEST(jsonrpc_unchanged_frame_is_an_empty_delta) {
+    EditorSession *session = numbered_session(30);
+    EditorViewModel *a = editor_session_snapshot(session);
+    EditorViewModel *b = editor_session_snapshot(session);
+    char *delta = jsonrpc_serialize_viewmodel_delta(a, b);
+    ASSERT_NOT_NULL(delta);
+    ASSERT_STR_EQ(delta, "{}");
+
+    char *whole = jsonrpc_serialize_viewmodel(b);
+    ASSERT_TRUE(strstr(whole, "\"rows_content\"") != NULL);
+    ASSERT_TRUE(strlen(whole) > 20 * strlen(delta));
+    free(whole);
+    free(delta);
+    editor_viewmodel_free(a);
+    editor_viewmodel_free(b);
+    editor_session_free(session);
+}
+
+TEST(jsonrpc_edit_sends_the_changed_row) {
+    EditorSession *session = numbered_session(30);
+    EditorViewModel *a = editor_session_snapshot(session);
+    send_key(session, 'x');         /* Delete the character under the cursor */
+    EditorViewModel *b = editor_session_snapshot(session);
+    char *delta = jsonrpc_serialize_viewmodel_delta(a, b);
+    ASSERT_NOT_NULL(delta);
+
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, delta, strlen(delta)), 0);
+    ASSERT_EQ(delta_rows(&doc), 1);
+    const JsonValue *row = &json_object_get(&doc.root, "rows_content")->data.array_val.items[0];
+    ASSERT_EQ(json_object_get_int(row, "y", -1), 0);
+    ASSERT_NOT_NULL(json_object_get(row, "segments"));
+    const JsonValue *status = json_object_get(&doc.root, "status");
+    ASSERT_NOT_NULL(status);
+    ASSERT_EQ(json_object_get_bool(status, "dirty", 0), 1);
+    ASSERT_NULL(json_object_get(status, "mode"));         /* Unchanged */
+    json_doc_free(&doc);
+
+    free(delta);
+    editor_viewmodel_free(a);
+    editor_viewmodel_free(b);
+    editor_session_free(session);
+}
+
+TEST(jsonrpc_scroll_sends_moved_rows_by_reference) {
+    EditorSession *session = numbered_session(60);
+    EditorViewModel *a = editor_session_snapshot(session);
+    for (int i = 0; i < a->row_count; i++) send_key(session, 'j');   /* Scroll a line */
+    EditorViewModel *b = editor_session_snapshot(session);
+    char *delta = jsonrpc_serialize_viewmodel_delta(a, b);
+    ASSERT_NOT_NULL(delta);
+
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, delta, strlen(delta)), 0);
+    size_t n = delta_rows(&doc);
+    const JsonValue *rows = json_object_get(&doc.root, "rows_content");
+    int moved = 0, rebuilt = 0;
+    for (size_t i = 0; i < n; i++) {
+        const JsonValue *row = &rows->data.array_val.items[i];
+        if (json_object_get(row, "from")) {
+            ASSERT_EQ(json_object_get_int(row, "from", -1), json_object_get_int(row, "y", -1) + 1);
+            moved++;
+        } else {
+            rebuilt++;
+        }
+    }
+    ASSERT_TRUE(moved > 0);
+    ASSERT_TRUE(rebuilt <= 1);
+    json_doc_free(&doc);
+
+    free(delta);
+    editor_viewmodel_free(a);
+    editor_viewmodel_free(b);
+    editor_session_free(session);
+}
+
+TEST(jsonrpc_resized_frame_is_sent_whole) {
+    EditorSession *session = numbered_session(5);
+    EditorViewModel *a = editor_session_snapshot(session);
+    editor_session_resize(session, 20, 60);
+    EditorViewModel *b = editor_session_snapshot(session);
+    ASSERT_NULL(jsonrpc_serialize_viewmodel_delta(a, b));
+    editor_viewmodel_free(a);
+    editor_viewmodel_free(b);
+    editor_session_free(session);
+}
+
+TEST(jsonrpc_msgpack_viewmodel_matches_json) {
+    EditorSession *session = numbered_session(8);
+    EditorViewModel *vm = editor_session_snapshot(session);
+    char *json = jsonrpc_serialize_viewmodel(vm);
+    size_t len;
+    char *mp = jsonrpc_serialize_viewmodel_msgpack(vm, &len);
+    ASSERT_NOT_NULL(json);
+    ASSERT_NOT_NULL(mp);
+    ASSERT_TRUE(len < strlen(json));
+
+    JsonDoc a, b;
+    ASSERT_EQ(json_doc_parse(&a, json, strlen(json)), 0);
+    ASSERT_EQ(json_doc_parse_msgpack(&b, mp, len), 0);
+    ASSERT_EQ(json_object_get_int(&b.root, "rows", 0), json_object_get_int(&a.root, "rows", -1));
+    ASSERT_EQ(json_object_get_int(json_object_get(&b.root, "cursor"), "row", -1),
+              json_object_get_int(json_object_get(&a.root, "cursor"), "row", -2));
+    const JsonValue *ra = json_object_get(&a.root, "rows_content");
+    const JsonValue *rb = json_object_get(&b.root, "rows_content");
+    ASSERT_EQ((int)rb->data.array_val.count, (int)ra->data.array_val.count);
+    for (size_t i = 0; i < ra->data.array_val.count; i++) {
+        const JsonValue *sa = json_object_get(&ra->data.array_val.items[i], "segments");
+        const JsonValue *sb = json_object_get(&rb->data.array_val.items[i], "segments");
+        ASSERT_EQ((int)sb->data.array_val.count, (int)sa->data.array_val.count);
+        for (size_t j = 0; j < sa->data.array_val.count; j++)
+            ASSERT_STR_EQ(json_object_get_string(&sb->data.array_val.items[j], "text"),
+                          json_object_get_string(&sa->data.array_val.items[j], "text"));
+    }
+    json_doc_free(&a);
+    json_doc_free(&b);
+    free(json);
+    free(mp);
+    editor_viewmodel_free(vm);
+    editor_session_free(session);
+}
+
+/* Helper: Run the interactive harness on 'input', its responses in 'out' */
+static void run_rpc(const char *input, char *out, size_t out_size) {
+    FILE *in = tmpfile(), *res = tmpfile();
+    fputs(input, in);
+    rewind(in);
+    fflush(stdout);
+    int saved_in = dup(0), saved_out = dup(1);
+    dup2(fileno(in), 0);
+    dup2(fileno(res), 1);
+    EditorConfig config = {0};
+    jsonrpc_run_interactive(&config);
+    fflush(stdout);
+    dup2(saved_in, 0);
+    dup2(saved_out, 1);
+    close(saved_in);
+    close(saved_out);
+    clearerr(stdin);
+
+    rewind(res);
+    size_t n = fread(out, 1, out_size - 1, res);
+    out[n] = '\0';
+    fclose(in);
+    fclose(res);
+}
+
+static int starts_with(const char *s, const char *prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+TEST(jsonrpc_batch_answers_once) {
+    static char out[65536];
+    run_rpc("[{\"cmd\":\"event\",\"type\":\"key\",\"code\":105},"
+            "{\"cmd\":\"insert\",\"text\":\"batched\"},{\"cmd\":\"snapshot\"},"
+            "{\"cmd\":\"event\",\"type\":\"key\",\"code\":27}]\n"
+            "{\"cmd\":\"batch\",\"render\":false,\"commands\":[{\"cmd\":\"status\"}]}\n",
+            out, sizeof(out));
+    char *second = strchr(out, '\n');
+    ASSERT_NOT_NULL(second);
+    *second++ = '\0';
+
+    JsonDoc doc;
+    ASSERT_EQ(json_doc_parse(&doc, out, strlen(out)), 0);
+    ASSERT_EQ(json_object_get_bool(&doc.root, "ok", 0), 1);
+    ASSERT_EQ(json_object_get_int(&doc.root, "done", 0), 4);
+    ASSERT_EQ(json_object_get_int(&doc.root, "frame", 0), 1);
+    ASSERT_TRUE(strstr(out, "\"text\":\"batched\"") != NULL);
+    json_doc_free(&doc);
+    ASSERT_STR_EQ(second, "{\"ok\":true,\"done\":1}\n");
+}
+
+TEST(jsonrpc_batch_stops_at_a_failure) {
+    static char out[65536];
+    run_rpc("[{\"cmd\":\"status\"},{\"cmd\":\"bogus\"},{\"cmd\":\"quit\"}]\n"
+            "{\"cmd\":\"batch\",\"commands\":[[{\"cmd\":\"status\"}]]}\n"
+            "{\"cmd\":\"status\"}\n",
+            out, sizeof(out));
+    ASSERT_STR_EQ(out,
+        "{\"ok\":false,\"error\":\"Unknown command\",\"done\":1}\n"
+        "{\"ok\":false,\"error\":\"batch: batches do not nest\",\"done\":0}\n"
+        "{\"ok\":true,\"mode\":\"normal\",\"filename\":null,\"dirty\":false}\n");
+}
+
+TEST(jsonrpc_command_can_ask_for_its_frame) {
+    static char out[65536];
+    run_rpc("{\"cmd\":\"resize\",\"rows\":10,\"cols\":30,\"render\":true}\n"
+            "{\"cmd\":\"event\",\"type\":\"key\",\"code\":106,\"render\":true,\"since\":1}\n"
+            "{\"cmd\":\"event\",\"type\":\"key\",\"code\":106}\n",
+            out, sizeof(out));
+    ASSERT_TRUE(starts_with(out, "{\"ok\":true,\"frame\":1,\"viewmodel\":{\"rows\":10,"));
+    char *next = strchr(out, '\n') + 1;
+    ASSERT_TRUE(starts_with(next, "{\"ok\":true,\"frame\":2,\"base\":1,\"delta\":"));
+    ASSERT_STR_EQ(strchr(next, '\n') + 1, "{\"ok\":true}\n");
+}
+
+TEST(session_frame_is_refilled_in_place) {
+    EditorSession *session = numbered_session(30);
+    const EditorViewModel *a = editor_session_frame(session);
+    ASSERT_NOT_NULL(a);
+    const EditorRowView *rows = a->row_views;
+    const char *text = a->row_views[3].text;
+    ASSERT_STR_EQ(text, "line 3");
+
+    /* The same frame, in the same memory, without rebuilding a row */
+    const EditorViewModel *b = editor_session_frame(session);
+    ASSERT_TRUE(a == b);
+    ASSERT_EQ(b->rows_rebuilt, 0);
+    ASSERT_TRUE(b->row_views == rows);
+    ASSERT_TRUE(b->row_views[3].text == text);
+    ASSERT_EQ(b->row_views[3].prev_row, 3);
+
+    send_key(session, 'x');
+    b = editor_session_frame(session);
+    ASSERT_EQ(b->rows_rebuilt, 1);
+    ASSERT_TRUE(b->row_views == rows);
+    ASSERT_STR_EQ(b->row_views[0].text, "line ");
+    ASSERT_STR_EQ(b->row_views[3].text, "line 3");
+    ASSERT_EQ(b->row_views[0].prev_row, -1);
+    editor_session_free(session);
+}
+
+TEST(session_snapshot_into_matches_a_new_snapshot) {
+    EditorSession *session = numbered_session(60);
+    EditorViewModel *vm = editor_session_snapshot(session);
+    for (int i = 0; i < 15; i++) send_key(session, 'j');
+    send_key(session, 'x');
+    ASSERT_EQ(editor_session_snapshot_into(session, vm), 0);
+    EditorViewModel *fresh = editor_session_snapshot(session);
+
+    char *a = jsonrpc_serialize_viewmodel(vm);
+    char *b = jsonrpc_serialize_viewmodel(fresh);
+    ASSERT_NOT_NULL(a);
+    ASSERT_STR_EQ(a, b);
+    const char *edited = strstr(a, "\"line 5\"");   /* And "line 15", cut */
+    ASSERT_TRUE(edited && strstr(edited + 1, "\"line 5\"") != NULL);
+    free(a);
+    free(b);
+    editor_viewmodel_free(vm);
+    editor_viewmodel_free(fresh);
+    editor_session_free(session);
+}
+
+BEGIN_TEST_SUITE("JSON-RPC Viewmodels")
+    RUN_TEST(jsonrpc_unchanged_frame_is_an_empty_delta);
+    RUN_TEST(jsonrpc_edit_sends_the_changed_row);
+    RUN_TEST(jsonrpc_scroll_sends_moved_rows_by_reference);
+    RUN_TEST(jsonrpc_resized_frame_is_sent_whole);
+    RUN_TEST(jsonrpc_msgpack_viewmodel_matches_json);
+    RUN_TEST(jsonrpc_batch_answers_once);
+    RUN_TEST(jsonrpc_batch_stops_at_a_failure);
+    RUN_TEST(jsonrpc_command_can_ask_for_its_frame);
+    RUN_TEST(session_frame_is_refilled_in_place);
+    RUN_TEST(session_snapshot_into_matches_a_new_snapshot);
+END_TEST_SUITE()
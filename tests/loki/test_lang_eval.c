@@ -0,0 +1,239 @@
+/* test_lang_eval.c - Unit tests for evaluations off the UI thread
+ *
+ * Tests for:
+ * - eval_async() run on the caller's thread without the async queue
+ * - eval_async() on a worker: progress, completion and errors through the
+ *   queue, with a copy of the buffer taken when it starts
+ * - A newer evaluation cancelling the one running, and freeing the buffer
+ *   while one runs, with the queue full too
+ * - Callbacks run when the language signals them, not polled
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "lang_bridge.h"
+#include "async_queue.h"
+#include <uv.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static atomic_int release;          /* Lets a waiting evaluation finish */
+static atomic_int started;
+static uv_mutex_t seen_lock;
+static char seen[256];              /* The code last evaluated */
+static int done_calls, done_result;
+
+/* "wait" waits for release (or cancellation); "fail" fails */
+static int fake_eval_async(LokiLangEvalJob *job, const char *code) {
+    uv_mutex_lock(&seen_lock);
+    snprintf(seen, sizeof(seen), "%s", code);
+    uv_mutex_unlock(&seen_lock);
+    atomic_store(&started, 1);
+    if (strstr(code, "wait")) {
+        loki_lang_eval_progress(job, 0.5, "halfway");
+        while (!atomic_load(&release) && !loki_lang_eval_cancelled(job)) usleep(1000);
+    }
+    if (strstr(code, "fail")) {
+        loki_lang_eval_fail(job, "bad note");
+        return -1;
+    }
+    return 0;
+}
+
+static void fake_eval_done(editor_ctx_t *ctx, int result) {
+    (void)ctx;
+    done_calls++;
+    done_result = result;
+}
+
+static const LokiLangOps async_lang = {
+    .name = "asynclang",
+    .extensions = {".async", NULL},
+    .eval_async = fake_eval_async,
+    .eval_done = fake_eval_done,
+};
+
+static int callback_runs;
+
+static void fake_check_callbacks(editor_ctx_t *ctx, lua_State *L) {
+    (void)ctx;
+    (void)L;
+    callback_runs++;
+}
+
+static const LokiLangOps signalled_lang = {
+    .name = "signalledlang",
+    .extensions = {".signalled", NULL},
+    .check_callbacks = fake_check_callbacks,
+    .callbacks_signalled = 1,
+};
+
+static void init_async_ctx(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    ctx->model.filename = strdup("tune.async");
+    loki_lang_register(&async_lang);
+    atomic_store(&release, 0);
+    atomic_store(&started, 0);
+    done_calls = 0;
+    seen[0] = '\0';
+}
+
+/* Helper: Dispatch events until the buffer's evaluations are reported */
+static void drain(editor_ctx_t *ctx) {
+    for (int tries = 0; tries < 2000 && loki_lang_eval_pending(ctx) > 0; tries++) {
+        async_queue_dispatch_all(NULL, ctx);
+        usleep(1000);
+    }
+}
+
+TEST(lang_eval_async_runs_here_without_queue) {
+    editor_ctx_t ctx;
+    init_async_ctx(&ctx);
+
+    ASSERT_EQ(loki_lang_eval(&ctx, "c d e"), 0);
+    ASSERT_STR_EQ(seen, "c d e");
+    ASSERT_EQ(done_calls, 1);
+    ASSERT_EQ(done_result, 0);
+
+    ASSERT_EQ(loki_lang_eval(&ctx, "fail"), -1);
+    ASSERT_STR_EQ(loki_lang_get_error(&ctx), "bad note");
+    ASSERT_EQ(done_result, -1);
+    ASSERT_EQ(loki_lang_eval_pending(&ctx), 0);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(lang_eval_async_reports_through_queue) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    init_async_ctx(&ctx);
+
+    ASSERT_EQ(loki_lang_eval(&ctx, "wait"), 1);
+    ASSERT_EQ(loki_lang_eval_pending(&ctx), 1);
+    ASSERT_NOT_NULL(strstr(ctx.view.statusmsg, "evaluating"));
+
+    /* Progress while it runs */
+    for (int tries = 0; tries < 2000 && !strstr(ctx.view.statusmsg, "halfway"); tries++) {
+        async_queue_dispatch_all(NULL, &ctx);
+        usleep(1000);
+    }
+    ASSERT_STR_EQ(ctx.view.statusmsg, "asynclang: halfway 50%");
+    ASSERT_EQ(done_calls, 0);
+
+    atomic_store(&release, 1);
+    drain(&ctx);
+    ASSERT_EQ(loki_lang_eval_pending(&ctx), 0);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "asynclang: done");
+    ASSERT_EQ(done_calls, 1);
+
+    /* Errors come the same way */
+    ASSERT_EQ(loki_lang_eval(&ctx, "fail"), 1);
+    drain(&ctx);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "asynclang error: bad note");
+    ASSERT_EQ(done_result, -1);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+}
+
+TEST(lang_eval_buffer_async_takes_a_copy) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    init_async_ctx(&ctx);
+    editor_insert_row(&ctx, 0, "wait", 4);
+    editor_insert_row(&ctx, 1, "a b c", 5);
+
+    ASSERT_EQ(loki_lang_eval_buffer(&ctx), 1);
+    while (!atomic_load(&started)) usleep(1000);
+
+    /* Editing does not wait for it, nor change what it reads */
+    editor_row_set(&ctx, &ctx.model.row[1], "x y z", 5);
+    atomic_store(&release, 1);
+    drain(&ctx);
+    ASSERT_STR_EQ(seen, "wait\na b c\n");
+    ASSERT_EQ(done_calls, 1);
+
+    editor_ctx_free(&ctx);
+    async_queue_cleanup();
+}
+
+TEST(lang_eval_newer_cancels_running) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    init_async_ctx(&ctx);
+
+    ASSERT_EQ(loki_lang_eval(&ctx, "wait"), 1);
+    ASSERT_EQ(loki_lang_eval(&ctx, "e f g"), 1);
+    ASSERT_EQ(loki_lang_eval_pending(&ctx), 2);
+    drain(&ctx);
+    ASSERT_EQ(done_calls, 1);               /* Only the newer */
+    ASSERT_STR_EQ(ctx.view.statusmsg, "asynclang: done");
+
+    /* Stopping cancels it unreported; freeing the buffer waits for it */
+    ASSERT_EQ(loki_lang_eval(&ctx, "wait"), 1);
+    loki_lang_stop_all(&ctx);
+    drain(&ctx);
+    ASSERT_EQ(done_calls, 1);
+
+    atomic_store(&release, 0);
+    ASSERT_EQ(loki_lang_eval(&ctx, "wait"), 1);
+    editor_ctx_free(&ctx);
+    async_queue_dispatch_all(NULL, NULL);   /* Its completion is ignored */
+    ASSERT_EQ(done_calls, 1);
+    async_queue_cleanup();
+}
+
+/* Freeing the buffer while its evaluation's completion finds the queue full */
+TEST(lang_eval_detach_with_queue_full) {
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    while (async_queue_push_timer(NULL, 1, NULL) == 0) {}
+    editor_ctx_t ctx;
+    init_async_ctx(&ctx);
+
+    ASSERT_EQ(loki_lang_eval(&ctx, "e f g"), 1);
+    while (!atomic_load(&started)) usleep(1000);
+    /* The worker is done, and waiting for room for its completion */
+    usleep(20000);
+    editor_ctx_free(&ctx);
+    ASSERT_EQ(done_calls, 0);
+    async_queue_cleanup();
+}
+
+static void signal_from_thread(void *arg) {
+    loki_lang_callbacks_pending(arg);
+}
+
+TEST(lang_callbacks_run_when_signalled) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    loki_lang_register(&signalled_lang);
+    callback_runs = 0;
+
+    /* Not polled: the main loop needs no tick for it */
+    ASSERT_FALSE(loki_lang_has_callbacks());
+    loki_lang_check_callbacks(&ctx, NULL);
+    ASSERT_EQ(callback_runs, 0);
+
+    uv_thread_t thread;
+    ASSERT_EQ(uv_thread_create(&thread, signal_from_thread, (void *)&signalled_lang), 0);
+    uv_thread_join(&thread);
+    loki_lang_check_callbacks(&ctx, NULL);
+    ASSERT_EQ(callback_runs, 1);
+    loki_lang_check_callbacks(&ctx, NULL);
+    ASSERT_EQ(callback_runs, 1);
+
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Language Evaluation")
+    uv_mutex_init(&seen_lock);
+    RUN_TEST(lang_eval_async_runs_here_without_queue);
+    RUN_TEST(lang_eval_async_reports_through_queue);
+    RUN_TEST(lang_eval_buffer_async_takes_a_copy);
+    RUN_TEST(lang_eval_newer_cancels_running);
+    RUN_TEST(lang_eval_detach_with_queue_full);
+    RUN_TEST(lang_callbacks_run_when_signalled);
+END_TEST_SUITE()
@@ -13,6 +13,7 @@
 #include "loki/lua.h"
 #include "internal.h"
 #include "languages.h"
+#include "syntax.h"
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -422,6 +423,40 @@ TEST(register_language_invalid_argument) {
     free_ctx_with_lua(&ctx);
 }
 
+/* Test: a declared language is loaded by the first lookup of one of its
+ * extensions, and only once */
+TEST(declare_language_loads_on_lookup) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    syntax_set_miss_hook(lua_declared_language_load);
+
+    const char *code =
+        "loaded = 0\n"
+        "loki.declare_language({'.lazya', 'lazyb'}, function(ext)\n"
+        "  loaded = loaded + 1\n"
+        "  loki.register_language({name = 'Lazy', extensions = {'.lazya', '.lazyb'}})\n"
+        "end)";
+
+    int result = luaL_dostring(ctx_L(&ctx), code);
+    ASSERT_EQ(result, 0);
+
+    lua_getglobal(ctx_L(&ctx), "loaded");
+    ASSERT_EQ(lua_tointeger(ctx_L(&ctx), -1), 0);
+    lua_pop(ctx_L(&ctx), 1);
+
+    ASSERT_NOT_NULL(syntax_for_filename("file.lazyb"));
+    ASSERT_NOT_NULL(syntax_for_filename("other.lazya"));
+    ASSERT_NULL(syntax_for_filename("file.notlazy"));
+
+    lua_getglobal(ctx_L(&ctx), "loaded");
+    ASSERT_EQ(lua_tointeger(ctx_L(&ctx), -1), 1);
+    lua_pop(ctx_L(&ctx), 1);
+
+    /* Cleanup */
+    syntax_set_miss_hook(NULL);
+    free_ctx_with_lua(&ctx);
+}
+
 BEGIN_TEST_SUITE("Language Registration")
     RUN_TEST(register_language_minimal_config);
     RUN_TEST(register_language_full_config);
@@ -440,4 +475,5 @@ BEGIN_TEST_SUITE("Language Registration")
     RUN_TEST(register_language_disable_string_highlighting);
     RUN_TEST(register_language_disable_number_highlighting);
     RUN_TEST(register_language_invalid_argument);
+    RUN_TEST(declare_language_loads_on_lookup);
 END_TEST_SUITE()
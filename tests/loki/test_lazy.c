@@ -0,0 +1,223 @@
+/* test_lazy.c - Unit tests for files loaded a window at a time
+ *
+ * Tests for:
+ * - Opening a file over the size limit as a window of lines
+ * - :N and :N% loading the window around a line
+ * - The window following the cursor
+ * - Edits refused
+ * - View mode and searching the whole file
+ * - Binary files in hex: searching bytes, typing over them and saving
+ */
+
+#include "test_framework.h"
+#include "lazy.h"
+#include "internal.h"
+#include "search.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_FILE "/tmp/loki_test_lazy.txt"
+#define TEST_LINES 20000
+
+static void write_lines(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int i = 0; i < TEST_LINES; i++) fprintf(fp, "line %d\n", i);
+    fclose(fp);
+}
+
+/* The file line the cursor is on */
+static int cursor_line(editor_ctx_t *ctx) {
+    return lazy_base(&ctx->model) + ctx->view.rowoff + ctx->view.cy;
+}
+
+static const char *cursor_text(editor_ctx_t *ctx) {
+    return ctx->model.row[ctx->view.rowoff + ctx->view.cy].chars;
+}
+
+TEST(lazy_open_loads_a_window) {
+    write_lines();
+    lazy_set_min_bytes(1);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    ASSERT_NOT_NULL(ctx.model.lazy);
+    ASSERT_EQ(ctx.model.numrows, LAZY_WINDOW_ROWS);
+    ASSERT_EQ(lazy_base(&ctx.model), 0);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line 0");
+
+    lazy_wait_index(&ctx.model);
+    ASSERT_EQ(lazy_lines(&ctx.model), TEST_LINES);
+
+    /* :N */
+    ASSERT_EQ(lazy_goto(&ctx, 12345), 12345);
+    ASSERT_EQ(cursor_line(&ctx), 12345);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 12345");
+    ASSERT_EQ(lazy_goto(&ctx, TEST_LINES + 10), TEST_LINES - 1);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 19999");
+
+    /* :N% lands on the start of a line, numbered once indexed */
+    lazy_goto_percent(&ctx, 50);
+    int line = cursor_line(&ctx);
+    ASSERT_TRUE(line > TEST_LINES / 2 - 1000 && line < TEST_LINES / 2 + 1000);
+    char expect[32];
+    snprintf(expect, sizeof(expect), "line %d", line);
+    ASSERT_STR_EQ(cursor_text(&ctx), expect);
+
+    editor_ctx_free(&ctx);
+    lazy_set_min_bytes(LAZY_MIN_BYTES);
+    remove(TEST_FILE);
+}
+
+TEST(lazy_window_follows_cursor) {
+    write_lines();
+    lazy_set_min_bytes(1);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    lazy_wait_index(&ctx.model);
+
+    /* Down past the margin: the window moves, the cursor stays on its line */
+    editor_cursor_to(&ctx, LAZY_WINDOW_ROWS - 10, 0);
+    lazy_follow_cursor(&ctx);
+    ASSERT_TRUE(lazy_base(&ctx.model) > 0);
+    ASSERT_EQ(cursor_line(&ctx), LAZY_WINDOW_ROWS - 10);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 4086");
+
+    /* And up: the window goes back to the top of the file */
+    editor_cursor_to(&ctx, 0, 0);
+    lazy_follow_cursor(&ctx);
+    ASSERT_EQ(lazy_base(&ctx.model), 0);
+    ASSERT_EQ(cursor_line(&ctx), 2038);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 2038");
+
+    editor_ctx_free(&ctx);
+    lazy_set_min_bytes(LAZY_MIN_BYTES);
+    remove(TEST_FILE);
+}
+
+TEST(lazy_refuses_edits) {
+    write_lines();
+    lazy_set_min_bytes(1);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+
+    editor_insert_char(&ctx, 'x');
+    editor_insert_newline(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line 0");
+    ASSERT_EQ(ctx.model.dirty, 0);
+    ASSERT_EQ(editor_save(&ctx), -1);
+
+    editor_ctx_free(&ctx);
+    lazy_set_min_bytes(LAZY_MIN_BYTES);
+    remove(TEST_FILE);
+}
+
+TEST(lazy_view_searches_whole_file) {
+    write_lines();
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    /* Well under lazy_min_bytes() */
+    ASSERT_EQ(editor_open_view(&ctx, TEST_FILE), 0);
+    ASSERT_NOT_NULL(ctx.model.lazy);
+    ASSERT_EQ(ctx.model.numrows, LAZY_WINDOW_ROWS);
+
+    /* Past the window: the window around the match is loaded */
+    int off = -1;
+    int row = editor_find_next_match(&ctx, "line 15000", -1, 1, &off);
+    ASSERT_TRUE(row >= 0);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, "line 15000");
+    ASSERT_EQ(off, 0);
+
+    /* Backward, to the nearest match above */
+    row = editor_find_next_match(&ctx, "line 12", row, -1, &off);
+    ASSERT_TRUE(row >= 0);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, "line 12999");
+
+    /* Forward from the end wraps to the top; backward from the top to the
+     * end */
+    row = editor_find_next_match(&ctx, "line 19999", row, 1, &off);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, "line 19999");
+    row = editor_find_next_match(&ctx, "line 0", row, 1, &off);
+    ASSERT_EQ(row, 0);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, "line 0");
+    row = editor_find_next_match(&ctx, "e 19998", row, -1, &off);
+    ASSERT_TRUE(row >= 0);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, "line 19998");
+    ASSERT_EQ(off, 3);
+
+    ASSERT_EQ(editor_find_next_match(&ctx, "nowhere", row, 1, &off), -1);
+
+    editor_ctx_free(&ctx);
+    remove(TEST_FILE);
+}
+
+#define HEX_FILE "/tmp/loki_test_lazy.bin"
+#define HEX_BYTES 100000
+
+TEST(lazy_hex_view_edits_and_saves_pages) {
+    FILE *fp = fopen(HEX_FILE, "wb");
+    for (int i = 0; i < HEX_BYTES; i++)
+        fputc(i == 70000 ? 0xde : i == 70001 ? 0xad : i % 7 == 0 ? 0 : 'a', fp);
+    fclose(fp);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    ctx.view.screencols = 120;
+    ASSERT_EQ(editor_open(&ctx, HEX_FILE), 0);
+    ASSERT_TRUE(lazy_is_hex(&ctx.model));
+    ASSERT_EQ(ctx.model.numrows, LAZY_WINDOW_ROWS);
+    ASSERT_EQ(lazy_lines(&ctx.model), (HEX_BYTES + 15) / 16);
+    ASSERT_STR_EQ(ctx.model.row[1].chars,
+                  "00000010: 61 61 61 61 61 00 61 61 61 61 61 61 00 61 61 61  "
+                  "aaaaa.aaaaaa.aaa");
+
+    /* Bytes, past the window */
+    int off = -1;
+    int row = editor_find_next_match(&ctx, "dead", -1, 1, &off);
+    ASSERT_TRUE(row >= 0);
+    ASSERT_EQ(lazy_base(&ctx.model) + row, 70000 / 16);
+    ASSERT_EQ(off, 10 + 3 * (70000 % 16));
+
+    /* Typing over the first byte's digits, then its character */
+    editor_cursor_to(&ctx, 0, 0);
+    lazy_goto(&ctx, 0);
+    editor_cursor_to(&ctx, 0, 10);
+    editor_insert_char(&ctx, '4');
+    editor_insert_char(&ctx, '2');
+    ASSERT_EQ(ctx.view.coloff + ctx.view.cx, 13);
+    editor_cursor_to(&ctx, 0, 59);
+    editor_insert_char(&ctx, 'Z');
+    ASSERT_TRUE(strncmp(ctx.model.row[0].chars, "00000000: 5a 61", 15) == 0);
+    ASSERT_TRUE(ctx.model.dirty > 0);
+
+    /* Nothing can be inserted; the changed page is saved */
+    editor_insert_newline(&ctx);
+    ASSERT_EQ(ctx.model.numrows, LAZY_WINDOW_ROWS);
+    ASSERT_EQ(editor_save(&ctx), 0);
+    ASSERT_EQ(ctx.model.dirty, 0);
+    editor_ctx_free(&ctx);
+
+    fp = fopen(HEX_FILE, "rb");
+    unsigned char head[2];
+    ASSERT_EQ((int)fread(head, 1, 2, fp), 2);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    ASSERT_EQ(head[0], 'Z');
+    ASSERT_EQ(head[1], 'a');
+    ASSERT_EQ((int)size, HEX_BYTES);
+    remove(HEX_FILE);
+}
+
+BEGIN_TEST_SUITE("Lazy Files")
+    RUN_TEST(lazy_open_loads_a_window);
+    RUN_TEST(lazy_window_follows_cursor);
+    RUN_TEST(lazy_refuses_edits);
+    RUN_TEST(lazy_view_searches_whole_file);
+    RUN_TEST(lazy_hex_view_edits_and_saves_pages);
+END_TEST_SUITE()
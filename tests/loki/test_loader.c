@@ -0,0 +1,288 @@
+/* test_loader.c - Unit tests for the file loading stage
+ *
+ * Tests for:
+ * - Line-offset index construction (LF, CRLF, missing final newline)
+ * - Per-line TAB counts from the vectorized scanner
+ * - Binary file detection
+ * - Mapping and releasing files
+ * - Newline counting and the sparse checkpoint index
+ */
+
+#include "test_framework.h"
+#include "loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TEST_FILE "/tmp/loki_test_loader.txt"
+
+TEST(index_lf_lines) {
+    const char *data = "one\ntwo\nthree\n";
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines(data, strlen(data), &index), 0);
+    ASSERT_EQ(index.count, 3);
+    ASSERT_EQ((int)index.start[0], 0);
+    ASSERT_EQ(index.len[0], 3);
+    ASSERT_EQ((int)index.start[1], 4);
+    ASSERT_EQ(index.len[1], 3);
+    ASSERT_EQ((int)index.start[2], 8);
+    ASSERT_EQ(index.len[2], 5);
+
+    loader_index_free(&index);
+}
+
+TEST(index_strips_crlf) {
+    const char *data = "a\r\nbb\r\n";
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines(data, strlen(data), &index), 0);
+    ASSERT_EQ(index.count, 2);
+    ASSERT_EQ(index.len[0], 1);
+    ASSERT_EQ(index.len[1], 2);
+
+    loader_index_free(&index);
+}
+
+TEST(index_keeps_unterminated_last_line) {
+    const char *data = "first\nlast";
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines(data, strlen(data), &index), 0);
+    ASSERT_EQ(index.count, 2);
+    ASSERT_EQ((int)index.start[1], 6);
+    ASSERT_EQ(index.len[1], 4);
+
+    loader_index_free(&index);
+}
+
+TEST(index_empty_lines_and_empty_input) {
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines("\n\n", 2, &index), 0);
+    ASSERT_EQ(index.count, 2);
+    ASSERT_EQ(index.len[0], 0);
+    ASSERT_EQ(index.len[1], 0);
+    loader_index_free(&index);
+
+    ASSERT_EQ(loader_index_lines(NULL, 0, &index), 0);
+    ASSERT_EQ(index.count, 0);
+    loader_index_free(&index);
+}
+
+TEST(index_grows_past_initial_capacity) {
+    char data[5000 * 2];
+    for (int i = 0; i < 5000; i++) {
+        data[i * 2] = 'x';
+        data[i * 2 + 1] = '\n';
+    }
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines(data, sizeof(data), &index), 0);
+    ASSERT_EQ(index.count, 5000);
+    ASSERT_EQ((int)index.start[4999], 9998);
+    ASSERT_EQ(index.len[4999], 1);
+
+    loader_index_free(&index);
+}
+
+TEST(index_counts_tabs_per_line) {
+    /* Long enough that lines straddle several scan blocks. */
+    const char *data =
+        "\tone\n"
+        "no tabs here at all, just a fairly long line of text\n"
+        "\t\t\tthree\t\n"
+        "\t";
+    LineIndex index;
+
+    ASSERT_EQ(loader_index_lines(data, strlen(data), &index), 0);
+    ASSERT_EQ(index.count, 4);
+    ASSERT_EQ(index.tabs[0], 1);
+    ASSERT_EQ(index.tabs[1], 0);
+    ASSERT_EQ(index.tabs[2], 4);
+    ASSERT_EQ(index.tabs[3], 1);
+    ASSERT_EQ(index.len[2], 9);
+    ASSERT_FALSE(index.binary);
+
+    loader_index_free(&index);
+}
+
+TEST(index_matches_scalar_reference) {
+    /* Pseudo-random mix of separators, compared against a byte loop. */
+    static char data[4096 + 7];
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed = seed * 1103515245u + 12345u;
+        int r = (seed >> 16) % 16;
+        data[i] = r == 0 ? '\n' : r == 1 ? '\t' : r == 2 ? '\r' : 'a' + r;
+    }
+    LineIndex index;
+    ASSERT_EQ(loader_index_lines(data, sizeof(data), &index), 0);
+
+    int line = 0, tabs = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= sizeof(data); i++) {
+        if (i == sizeof(data) && start == i) break;
+        if (i == sizeof(data) || data[i] == '\n') {
+            size_t len = i - start;
+            while (len > 0 && data[start + len - 1] == '\r') len--;
+            ASSERT_TRUE(line < index.count);
+            ASSERT_EQ((int)index.start[line], (int)start);
+            ASSERT_EQ(index.len[line], (int)len);
+            ASSERT_EQ(index.tabs[line], tabs);
+            line++;
+            tabs = 0;
+            start = i + 1;
+        } else if (data[i] == '\t') {
+            tabs++;
+        }
+    }
+    ASSERT_EQ(index.count, line);
+
+    loader_index_free(&index);
+}
+
+TEST(index_flags_nul_in_probe_window) {
+    char data[2048];
+    LineIndex index;
+
+    memset(data, 'a', sizeof(data));
+    data[700] = '\0';
+    ASSERT_EQ(loader_index_lines(data, sizeof(data), &index), 0);
+    ASSERT_TRUE(index.binary);
+    ASSERT_EQ(index.count, 0);
+    loader_index_free(&index);
+
+    /* NUL bytes past the first 1KB do not make a file binary. */
+    data[700] = 'a';
+    data[1500] = '\0';
+    ASSERT_EQ(loader_index_lines(data, sizeof(data), &index), 0);
+    ASSERT_FALSE(index.binary);
+    ASSERT_EQ(index.count, 1);
+    loader_index_free(&index);
+}
+
+TEST(open_maps_file_and_detects_binary) {
+    FILE *f = fopen(TEST_FILE, "w");
+    ASSERT_NOT_NULL(f);
+    fputs("text\n", f);
+    fclose(f);
+
+    LoadedFile file;
+    ASSERT_EQ(loader_open(TEST_FILE, &file), 0);
+    ASSERT_EQ((int)file.size, 5);
+    ASSERT_TRUE(memcmp(file.data, "text\n", 5) == 0);
+    ASSERT_FALSE(loader_is_binary(&file));
+    loader_close(&file);
+    ASSERT_NULL(file.data);
+
+    f = fopen(TEST_FILE, "wb");
+    ASSERT_NOT_NULL(f);
+    fwrite("ab\0cd", 1, 5, f);
+    fclose(f);
+
+    ASSERT_EQ(loader_open(TEST_FILE, &file), 0);
+    ASSERT_TRUE(loader_is_binary(&file));
+    loader_close(&file);
+
+    remove(TEST_FILE);
+}
+
+TEST(open_missing_file_sets_enoent) {
+    LoadedFile file;
+    ASSERT_EQ(loader_open("/tmp/loki_test_loader_missing.txt", &file), -1);
+    ASSERT_EQ(errno, ENOENT);
+}
+
+TEST(count_and_skip_newlines) {
+    const char *data = "a\nbb\n\nccc";
+    size_t size = strlen(data);
+    int skipped;
+
+    ASSERT_EQ((int)loader_count_newlines(data, 0, size), 3);
+    ASSERT_EQ((int)loader_count_newlines(data, 2, 5), 1);
+    ASSERT_EQ((int)loader_skip_lines(data, size, 0, 2, &skipped), 5);
+    ASSERT_EQ(skipped, 2);
+    ASSERT_EQ((int)loader_skip_lines(data, size, 0, 0, &skipped), 0);
+    ASSERT_EQ(skipped, 0);
+
+    /* Fewer newlines than asked: past the last one */
+    ASSERT_EQ((int)loader_skip_lines(data, size, 0, 10, &skipped), 6);
+    ASSERT_EQ(skipped, 3);
+    ASSERT_EQ((int)loader_skip_lines(data, size, 7, 1, &skipped), 7);
+    ASSERT_EQ(skipped, 0);
+}
+
+/* 'lines' lines, line i being i % 50 'x' bytes, with or without a final
+ * newline. Sets *size and the start of every line in 'starts'. */
+static char *make_lines(int lines, int final_newline, size_t *starts,
+                        size_t *size) {
+    char *data = malloc((size_t)lines * 51);
+    size_t n = 0;
+    for (int i = 0; i < lines; i++) {
+        starts[i] = n;
+        memset(data + n, 'x', (size_t)(i % 50));
+        n += (size_t)(i % 50);
+        if (i < lines - 1 || final_newline) data[n++] = '\n';
+    }
+    *size = n;
+    return data;
+}
+
+TEST(ckpt_seeks_and_finds_lines) {
+    int lines = LOADER_CKPT_LINES * 5 + 37;
+    size_t *starts = malloc(sizeof(size_t) * (size_t)lines);
+
+    for (int final = 0; final <= 1; final++) {
+        size_t size, off;
+        char *data = make_lines(lines, final, starts, &size);
+        LineCkpt ck;
+        ASSERT_EQ(loader_ckpt_init(&ck, data, size), 0);
+        ASSERT_EQ(loader_ckpt_lines(&ck), -1);
+
+        /* Before any indexing, seeks scan from the top */
+        ASSERT_EQ(loader_ckpt_seek(&ck, 3000, &off), 3000);
+        ASSERT_EQ((int)off, (int)starts[3000]);
+        ASSERT_EQ(loader_ckpt_line_of(&ck, starts[3000]), -1);
+
+        /* A slice at a time */
+        int ret, slices = 0;
+        while ((ret = loader_ckpt_build(&ck, 4096)) == 0) slices++;
+        ASSERT_EQ(ret, 1);
+        ASSERT_TRUE(slices > 10);
+        ASSERT_EQ(loader_ckpt_lines(&ck), lines);
+
+        for (int i = 0; i < lines; i += 97) {
+            ASSERT_EQ(loader_ckpt_seek(&ck, i, &off), i);
+            ASSERT_EQ((int)off, (int)starts[i]);
+            ASSERT_EQ(loader_ckpt_line_of(&ck, starts[i]), i);
+            if (i % 50 > 1)
+                ASSERT_EQ(loader_ckpt_line_of(&ck, starts[i] + 1), i);
+        }
+        ASSERT_EQ(loader_ckpt_line_of(&ck, starts[lines - 1]), lines - 1);
+
+        /* Past the end: the last line */
+        ASSERT_EQ(loader_ckpt_seek(&ck, lines + 100, &off), lines - 1);
+        ASSERT_EQ((int)off, (int)starts[lines - 1]);
+
+        loader_ckpt_free(&ck);
+        free(data);
+    }
+    free(starts);
+}
+
+BEGIN_TEST_SUITE("File Loader")
+    RUN_TEST(index_lf_lines);
+    RUN_TEST(index_strips_crlf);
+    RUN_TEST(index_keeps_unterminated_last_line);
+    RUN_TEST(index_empty_lines_and_empty_input);
+    RUN_TEST(index_grows_past_initial_capacity);
+    RUN_TEST(index_counts_tabs_per_line);
+    RUN_TEST(index_matches_scalar_reference);
+    RUN_TEST(index_flags_nul_in_probe_window);
+    RUN_TEST(open_maps_file_and_detects_binary);
+    RUN_TEST(open_missing_file_sets_enoent);
+    RUN_TEST(count_and_skip_newlines);
+    RUN_TEST(ckpt_seeks_and_finds_lines);
+END_TEST_SUITE()
@@ -0,0 +1,425 @@
+/* test_lsp.c - Unit tests for the language server client
+ *
+ * The servers are shell commands: they write canned answers and save what
+ * they are sent to a file, which the tests read back.
+ *
+ * Tests for:
+ * - Edits sent as changes of the lines edited, which applied to the text
+ *   opened give the buffer's text, however the edits fall
+ * - Diagnostics decorated by severity, UTF-16 columns made bytes
+ * - Completion and hover requests debounced, a newer one replacing one
+ *   waiting and cancelling one sent, whose answer is then skipped
+ * - One server shared by buffers, and a server that exits
+ */
+
+#include "test_framework.h"
+#include "lsp.h"
+#include "decor.h"
+#include "internal.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#define LOG_PATH "/tmp/loki_test_lsp.log"
+#define FILE_PATH "/tmp/loki_test_lsp.c"
+#define FILE_URI "file:///tmp/loki_test_lsp.c"
+
+#define INIT_RESULT "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":{\"capabilities\":" \
+                    "{\"textDocumentSync\":2}}}"
+
+/* A shell command writing 'json' framed, for a server */
+static void frame(char *cmd, size_t size, const char *json) {
+    size_t at = strlen(cmd);
+    snprintf(cmd + at, size - at, "printf 'Content-Length: %zu\\r\\n\\r\\n'; printf '%%s' '%s'; ",
+             strlen(json), json);
+}
+
+static void fill(editor_ctx_t *ctx, int n) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 10;
+    ctx->view.screencols = 80;
+    char line[32];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "line %d", i);
+        editor_insert_row(ctx, i, line, (size_t)len);
+    }
+    ctx->model.filename = strdup(FILE_PATH);
+}
+
+/* Run the loop and the client, as the editor does, for 'ms' */
+static void run_for(int ms) {
+    uint64_t until = uv_hrtime() + (uint64_t)ms * 1000000;
+    while (uv_hrtime() < until) {
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        lsp_tick(uv_hrtime());
+    }
+}
+
+/* Send the edits made at once, as a request would */
+static void flush_edits(void) {
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    lsp_tick(uv_hrtime());
+    lsp_tick(uv_hrtime() + (uint64_t)10 * 1000000000);
+}
+
+static char *read_log(size_t *len) {
+    FILE *fp = fopen(LOG_PATH, "rb");
+    if (fp == NULL) return NULL;
+    static char buf[1 << 20];
+    *len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static int count_of(const char *text, const char *what) {
+    int n = 0;
+    for (const char *p = text; (p = strstr(p, what)) != NULL; p++) n++;
+    return n;
+}
+
+/* Wait, for five seconds at most, for the server to have been sent 'n'
+ * messages holding 'what' */
+static char *wait_log(const char *what, int n, size_t *len) {
+    uint64_t until = uv_hrtime() + (uint64_t)5 * 1000000000;
+    char *log;
+    do {
+        run_for(5);
+        log = read_log(len);
+    } while ((log == NULL || count_of(log, what) < n) && uv_hrtime() < until);
+    return log;
+}
+
+/* Offset of line 'line' in 'text' */
+static size_t line_offset(const char *text, size_t len, int line) {
+    size_t at = 0;
+    while (line > 0 && at < len) {
+        if (text[at++] == '\n') line--;
+    }
+    return at;
+}
+
+/* The text the server has from the messages it was sent: the text
+ * opened, with each change applied in order. Also the most changes one
+ * message had, and the most text one change had. */
+static char *server_text(const char *log, size_t log_len, int *most_changes,
+                         size_t *most_text) {
+    char *text = NULL;
+    size_t len = 0;
+    *most_changes = 0;
+    *most_text = 0;
+    const char *p = log, *end = log + log_len;
+    while ((p = strstr(p, "Content-Length: ")) != NULL) {
+        size_t body_len = (size_t)atol(p + 16);
+        const char *body = strstr(p, "\r\n\r\n") + 4;
+        if (body + body_len > end) break;
+        p = body + body_len;
+        JsonDoc doc;
+        if (json_doc_parse(&doc, body, body_len) != 0) {
+            json_doc_free(&doc);
+            continue;
+        }
+        const char *method = json_object_get_string(&doc.root, "method");
+        const JsonValue *params = json_object_get(&doc.root, "params");
+        if (method && strcmp(method, "textDocument/didOpen") == 0) {
+            const JsonValue *td = json_object_get(params, "textDocument");
+            const JsonValue *t = json_object_get(td, "text");
+            free(text);
+            len = t->data.string_val.len;
+            text = malloc(len + 1);
+            memcpy(text, t->data.string_val.str, len + 1);
+        } else if (method && strcmp(method, "textDocument/didChange") == 0) {
+            const JsonValue *changes = json_object_get(params, "contentChanges");
+            if ((int)changes->data.array_val.count > *most_changes)
+                *most_changes = (int)changes->data.array_val.count;
+            for (size_t i = 0; i < changes->data.array_val.count; i++) {
+                const JsonValue *c = &changes->data.array_val.items[i];
+                const JsonValue *range = json_object_get(c, "range");
+                const JsonValue *t = json_object_get(c, "text");
+                int start = json_object_get_int(json_object_get(range, "start"), "line", 0);
+                int stop = json_object_get_int(json_object_get(range, "end"), "line", 0);
+                size_t from = line_offset(text, len, start);
+                size_t to = line_offset(text, len, stop);
+                size_t n = t->data.string_val.len;
+                if (n > *most_text) *most_text = n;
+                char *next = malloc(len - (to - from) + n + 1);
+                memcpy(next, text, from);
+                memcpy(next + from, t->data.string_val.str, n);
+                memcpy(next + from + n, text + to, len - to + 1);
+                free(text);
+                text = next;
+                len = len - (to - from) + n;
+            }
+        }
+        json_doc_free(&doc);
+    }
+    return text;
+}
+
+/* The buffer's text as the server should have it */
+static char *buffer_text(const editor_ctx_t *ctx) {
+    size_t len = 0;
+    for (int r = 0; r < ctx->model.numrows; r++) len += (size_t)ctx->model.row[r].size + 1;
+    char *text = malloc(len + 1), *p = text;
+    for (int r = 0; r < ctx->model.numrows; r++) {
+        memcpy(p, ctx->model.row[r].chars, (size_t)ctx->model.row[r].size);
+        p += ctx->model.row[r].size;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return text;
+}
+
+/* A server that answers initialize, and saves what it is sent */
+static void start_server(editor_ctx_t *ctx) {
+    char cmd[1024] = "";
+    frame(cmd, sizeof(cmd), INIT_RESULT);
+    strcat(cmd, "exec cat > " LOG_PATH);
+    unlink(LOG_PATH);
+    ASSERT_EQ(lsp_start(ctx, cmd), 0);
+}
+
+TEST(lsp_edits_sent_as_line_changes) {
+    editor_ctx_t ctx;
+    fill(&ctx, 2000);
+    start_server(&ctx);
+    size_t len;
+    char *log = wait_log("didOpen", 1, &len);
+    ASSERT_NOT_NULL(log);
+
+    /* One character typed on a line of a large file: that line goes */
+    int size = ctx.model.row[1000].size;
+    editor_replace_range(&ctx, 1000, size, 1000, size, "x", 1, NULL, NULL);
+    editor_replace_range(&ctx, 1000, size + 1, 1000, size + 1, "y", 1, NULL, NULL);
+    flush_edits();
+    log = wait_log("didChange", 1, &len);
+    int most_changes;
+    size_t most_text;
+    char *server = server_text(log, len, &most_changes, &most_text);
+    char *buffer = buffer_text(&ctx);
+    ASSERT_STR_EQ(server, buffer);
+    ASSERT_EQ(most_changes, 1);
+    ASSERT_EQ((int)most_text, (int)strlen("line 1000xy\n"));
+    free(server);
+    free(buffer);
+
+    /* Edits of every kind, anywhere, sent every few */
+    srand(118);
+    int sent = 1;
+    for (int i = 0; i < 400; i++) {
+        int n = ctx.model.numrows;
+        int at = n > 0 ? rand() % (n + 1) : 0;
+        switch (rand() % 5) {
+        case 0:
+            editor_insert_row(&ctx, at, "new", 3);
+            break;
+        case 1:
+            if (at < n) editor_del_row(&ctx, at);
+            break;
+        case 2:
+            if (at < n) editor_del_rows(&ctx, at, 1 + rand() % 5);
+            break;
+        case 3:
+            if (at < n) editor_replace_range(&ctx, at, 0, at, 0, "a", 1, NULL, NULL);
+            break;
+        default:
+            if (at < n) {
+                int end = at + rand() % 3;
+                if (end >= n) end = n - 1;
+                const char *text = rand() % 2 ? "p\nq" : "r";
+                editor_replace_range(&ctx, at, 0, end, ctx.model.row[end].size > 1 ? 1 : 0,
+                                     text, strlen(text), NULL, NULL);
+            }
+            break;
+        }
+        if (i % 7 == 6 || i == 399) {
+            flush_edits();
+            sent++;
+        }
+    }
+    log = wait_log("didChange", sent, &len);
+    server = server_text(log, len, &most_changes, &most_text);
+    buffer = buffer_text(&ctx);
+    ASSERT_STR_EQ(server, buffer);
+    ASSERT_TRUE(most_changes <= LSP_MAX_SPANS);
+    free(server);
+    free(buffer);
+
+    editor_ctx_free(&ctx);
+    lsp_stop_all();
+    run_for(20);
+}
+
+TEST(lsp_diagnostics_decorated) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 10;
+    editor_insert_row(&ctx, 0, "int x;", 6);
+    editor_insert_row(&ctx, 1, "\xc3\xa9 = y;", 7);      /* é: 2 bytes, 1 unit */
+    ctx.model.filename = strdup(FILE_PATH);
+
+    char cmd[2048] = "";
+    frame(cmd, sizeof(cmd), INIT_RESULT);
+    frame(cmd, sizeof(cmd),
+          "{\"jsonrpc\":\"2.0\",\"method\":\"window/logMessage\",\"params\":{\"type\":3,\"message\":\"hi\"}}");
+    frame(cmd, sizeof(cmd),
+          "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":"
+          "{\"uri\":\"" FILE_URI "\",\"diagnostics\":["
+          "{\"range\":{\"start\":{\"line\":1,\"character\":4},\"end\":{\"line\":1,\"character\":5}},"
+          "\"severity\":1,\"message\":\"undeclared y\"},"
+          "{\"range\":{\"start\":{\"line\":0,\"character\":4},\"end\":{\"line\":0,\"character\":5}},"
+          "\"severity\":2,\"message\":\"unused x\"}]}}");
+    strcat(cmd, "exec cat > /dev/null");
+    ASSERT_EQ(lsp_start(&ctx, cmd), 0);
+
+    const LspDiagnostic *diags = NULL;
+    uint64_t until = uv_hrtime() + (uint64_t)5 * 1000000000;
+    while (lsp_diagnostics(&ctx.model, &diags) == 0 && uv_hrtime() < until) run_for(5);
+    ASSERT_EQ(lsp_diagnostics(&ctx.model, &diags), 2);
+    ASSERT_EQ(diags[0].row, 1);
+    ASSERT_EQ(diags[0].col, 5);
+    ASSERT_EQ(diags[0].end_col, 6);
+    ASSERT_EQ(diags[0].severity, 1);
+    ASSERT_STR_EQ(diags[0].message, "undeclared y");
+    ASSERT_EQ(diags[1].col, 4);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_LSP), 2);
+
+    /* Closed: they go */
+    lsp_stop(&ctx.model);
+    ASSERT_NULL(ctx.model.lsp);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_LSP), 0);
+    editor_ctx_free(&ctx);
+    lsp_stop_all();
+    run_for(20);
+}
+
+/* What the requests got */
+static int cancelled, answered, last_count;
+static char last_label[64], last_insert[64], last_hover[64];
+
+static void on_result(editor_ctx_t *ctx, const LspResult *result, void *opaque) {
+    (void)ctx;
+    (void)opaque;
+    if (result->cancelled) {
+        cancelled++;
+        return;
+    }
+    answered++;
+    if (result->kind == LSP_REQ_HOVER) {
+        snprintf(last_hover, sizeof(last_hover), "%s", result->text ? result->text : "");
+        return;
+    }
+    last_count = result->count;
+    if (result->count > 0) {
+        snprintf(last_label, sizeof(last_label), "%s", result->items[0].label);
+        snprintf(last_insert, sizeof(last_insert), "%s", result->items[0].insert);
+    }
+}
+
+TEST(lsp_requests_debounced_and_cancelled) {
+    editor_ctx_t ctx;
+    fill(&ctx, 3);
+    cancelled = answered = last_count = 0;
+
+    /* Answers to requests 2 (cancelled by then) and 3, and hover 4 */
+    char answers[2048] = "";
+    frame(answers, sizeof(answers),
+          "{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":[{\"label\":\"stale\"}]}");
+    frame(answers, sizeof(answers),
+          "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":{\"isIncomplete\":false,\"items\":["
+          "{\"label\":\"printf\",\"textEdit\":{\"newText\":\"printf(\"}},{\"label\":\"puts\"}]}}");
+    frame(answers, sizeof(answers),
+          "{\"jsonrpc\":\"2.0\",\"id\":4,\"result\":{\"contents\":{\"kind\":\"plaintext\",\"value\":\"int main(void)\"}}}");
+    char cmd[4096] = "";
+    frame(cmd, sizeof(cmd), INIT_RESULT);
+    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd),
+             "(sleep 0.5; %s) & exec cat > " LOG_PATH, answers);
+    unlink(LOG_PATH);
+    ASSERT_EQ(lsp_start(&ctx, cmd), 0);
+    size_t len;
+    ASSERT_NOT_NULL(wait_log("didOpen", 1, &len));
+
+    /* A request replaced while it waits is never sent */
+    ASSERT_EQ(lsp_request(&ctx, LSP_REQ_COMPLETION, on_result, NULL), 0);
+    ASSERT_EQ(lsp_request(&ctx, LSP_REQ_COMPLETION, on_result, NULL), 0);
+    ASSERT_EQ(cancelled, 1);
+    ASSERT_TRUE(lsp_tick(uv_hrtime()) > 0);     /* Waiting */
+    lsp_tick(uv_hrtime() + (uint64_t)10 * 1000000000);
+
+    /* One sent is cancelled by a newer one */
+    ASSERT_EQ(lsp_request(&ctx, LSP_REQ_COMPLETION, on_result, NULL), 0);
+    ASSERT_EQ(cancelled, 2);
+    lsp_tick(uv_hrtime() + (uint64_t)10 * 1000000000);
+    ASSERT_EQ(lsp_request(&ctx, LSP_REQ_HOVER, on_result, NULL), 0);
+    lsp_tick(uv_hrtime() + (uint64_t)10 * 1000000000);
+
+    char *log = wait_log("cancelRequest", 1, &len);
+    ASSERT_EQ(count_of(log, "textDocument/completion"), 2);
+    ASSERT_TRUE(strstr(log, "\"method\":\"$/cancelRequest\",\"params\":{\"id\":2}") != NULL);
+
+    uint64_t until = uv_hrtime() + (uint64_t)5 * 1000000000;
+    while (answered < 2 && uv_hrtime() < until) run_for(5);
+    ASSERT_EQ(answered, 2);
+    ASSERT_EQ(cancelled, 2);
+    ASSERT_EQ(last_count, 2);
+    ASSERT_STR_EQ(last_label, "printf");
+    ASSERT_STR_EQ(last_insert, "printf(");
+    ASSERT_STR_EQ(last_hover, "int main(void)");
+
+    /* Without a server */
+    lsp_stop(&ctx.model);
+    ASSERT_EQ(lsp_request(&ctx, LSP_REQ_HOVER, on_result, NULL), -1);
+    editor_ctx_free(&ctx);
+    lsp_stop_all();
+    run_for(20);
+}
+
+TEST(lsp_server_shared_and_exit) {
+    editor_ctx_t a, b;
+    fill(&a, 2);
+    fill(&b, 2);
+    free(b.model.filename);
+    b.model.filename = strdup("/tmp/loki_test_lsp_other.c");
+    start_server(&a);
+    ASSERT_EQ(lsp_start(&b, lsp_server(&a.model)), 0);
+    ASSERT_TRUE(strstr(b.view.statusmsg, "attached") != NULL);
+    size_t len;
+    char *log = wait_log("didOpen", 2, &len);
+    ASSERT_EQ(count_of(log, "\"method\":\"initialize\""), 1);
+    ASSERT_TRUE(strstr(log, "loki_test_lsp_other.c") != NULL);
+
+    /* One closed: the server stays for the other */
+    lsp_stop(&a.model);
+    log = wait_log("didClose", 1, &len);
+    ASSERT_EQ(count_of(log, "\"method\":\"shutdown\""), 0);
+    ASSERT_NOT_NULL(b.model.lsp);
+    editor_ctx_free(&a);
+    editor_ctx_free(&b);
+    lsp_stop_all();
+    run_for(20);
+
+    /* A server that exits takes its buffers off */
+    editor_ctx_t c;
+    fill(&c, 1);
+    char cmd[512] = "";
+    frame(cmd, sizeof(cmd), INIT_RESULT);
+    strcat(cmd, "sleep 0.1");
+    ASSERT_EQ(lsp_start(&c, cmd), 0);
+    uint64_t until = uv_hrtime() + (uint64_t)5 * 1000000000;
+    while (c.model.lsp && uv_hrtime() < until) run_for(5);
+    ASSERT_NULL(c.model.lsp);
+    ASSERT_TRUE(strstr(c.view.statusmsg, "exited") != NULL);
+    editor_ctx_free(&c);
+    run_for(20);
+    unlink(LOG_PATH);
+}
+
+BEGIN_TEST_SUITE("lsp")
+    RUN_TEST(lsp_edits_sent_as_line_changes);
+    RUN_TEST(lsp_diagnostics_decorated);
+    RUN_TEST(lsp_requests_debounced_and_cancelled);
+    RUN_TEST(lsp_server_shared_and_exit);
+END_TEST_SUITE()
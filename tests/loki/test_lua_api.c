@@ -7,18 +7,37 @@
  * - loki.get_line() function
  * - loki.get_cursor() function
  * - loki.insert_text() function
+ * - loki.delete_text() function
  * - loki.get_filename() function
  * - loki.set_color() function
  * - loki.register_language() function
+ * - loki.buffer() handles: line, lines, find, slices, a closed buffer
+ * - loki.keymap() dispatch, and callbacks released on remap and unmap
+ * - loki.async() and loki.await(): answered at once, or resumed later;
+ *   loki.sleep()
+ * - Entry point timings and the sampling profiler
+ * - Collector steps in idle time, and stopped during input bursts
  */
 
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
 #include "test_framework.h"
 #include "loki/core.h"
 #include "loki/lua.h"
 #include "internal.h"
+#include "buffers.h"
+#include "async_queue.h"
+#include "timer_wheel.h"
+#include "lua_profile.h"
+#include "lua_gc.h"
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Helper to initialize context with Lua */
 static void init_ctx_with_lua(editor_ctx_t *ctx) {
@@ -82,7 +101,6 @@ TEST(lua_get_lines_returns_count) {
     for (int i = 0; i < 3; i++) {
         ctx.model.row[i].chars = strdup("test");
         ctx.model.row[i].size = 4;
-        ctx.model.row[i].idx = i;
     }
 
     /* Call loki.get_lines() */
@@ -108,11 +126,9 @@ TEST(lua_get_line_returns_content) {
 
     ctx.model.row[0].chars = strdup("First line");
     ctx.model.row[0].size = 10;
-    ctx.model.row[0].idx = 0;
 
     ctx.model.row[1].chars = strdup("Second line");
     ctx.model.row[1].size = 11;
-    ctx.model.row[1].idx = 1;
 
     /* Call loki.get_line(0) */
     const char *code1 = "return loki.get_line(0)";
@@ -135,6 +151,73 @@ TEST(lua_get_line_returns_content) {
     free_ctx_with_lua(&ctx);
 }
 
+/* Test loki.search() */
+TEST(lua_search_finds_regex_and_literal_matches) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+
+    ctx.model.numrows = 2;
+    ctx.model.row = calloc(2, sizeof(t_erow));
+    ctx.model.row[0].chars = strdup("no digits here");
+    ctx.model.row[0].size = 14;
+    ctx.model.row[1].chars = strdup("x = a.b + 42");
+    ctx.model.row[1].size = 12;
+
+    lua_State *L = ctx_L(&ctx);
+    ASSERT_EQ(luaL_dostring(L, "return loki.search('[0-9]+')"), 0);
+    ASSERT_EQ(lua_tointeger(L, -3), 1);
+    ASSERT_EQ(lua_tointeger(L, -2), 10);
+    ASSERT_EQ(lua_tointeger(L, -1), 2);
+    lua_settop(L, 0);
+
+    /* '.' is matched as itself */
+    ASSERT_EQ(luaL_dostring(L, "return loki.search('a.b', {literal = true})"), 0);
+    ASSERT_EQ(lua_tointeger(L, -2), 4);
+    lua_settop(L, 0);
+
+    /* No wrapping past the start position */
+    ASSERT_EQ(luaL_dostring(L, "return loki.search('no', {row = 1})"), 0);
+    ASSERT_TRUE(lua_isnil(L, -1));
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "return loki.search('(')"), 0);
+    ASSERT_TRUE(lua_isnil(L, -2));
+    ASSERT_TRUE(lua_isstring(L, -1));
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test loki.grep() */
+TEST(lua_grep_returns_matches_across_files) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+
+    system("rm -rf /tmp/loki_lua_grep && mkdir -p /tmp/loki_lua_grep");
+    FILE *fp = fopen("/tmp/loki_lua_grep/a.txt", "w");
+    fputs("alpha\nx = 42\n", fp);
+    fclose(fp);
+
+    lua_State *L = ctx_L(&ctx);
+    ASSERT_EQ(luaL_dostring(L,
+        "local r = loki.grep('[0-9]+', '/tmp/loki_lua_grep')\n"
+        "return #r, r[1].file, r[1].line, r[1].col, r[1].text"), 0);
+    ASSERT_EQ(lua_tointeger(L, -5), 1);
+    ASSERT_STR_EQ(lua_tostring(L, -4), "/tmp/loki_lua_grep/a.txt");
+    ASSERT_EQ(lua_tointeger(L, -3), 2);
+    ASSERT_EQ(lua_tointeger(L, -2), 5);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "x = 42");
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "return loki.grep('(')"), 0);
+    ASSERT_TRUE(lua_isnil(L, -2));
+    ASSERT_TRUE(lua_isstring(L, -1));
+    lua_settop(L, 0);
+
+    system("rm -rf /tmp/loki_lua_grep");
+    free_ctx_with_lua(&ctx);
+}
+
 /* Test loki.get_line() with out of bounds */
 TEST(lua_get_line_handles_out_of_bounds) {
     editor_ctx_t ctx;
@@ -189,9 +272,8 @@ TEST(lua_insert_text_adds_content) {
     ctx.model.row[0].chars[0] = '\0';
     ctx.model.row[0].size = 0;
     ctx.model.row[0].render = NULL;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
     ctx.model.row[0].rsize = 0;
-    ctx.model.row[0].idx = 0;
 
     ctx.view.cx = 0;
     ctx.view.cy = 0;
@@ -203,12 +285,34 @@ TEST(lua_insert_text_adds_content) {
     ASSERT_EQ(result, 0);
     ASSERT_EQ(ctx.model.row[0].size, 5);
     ASSERT_STR_EQ(ctx.model.row[0].chars, "Hello");
-    ASSERT_EQ(ctx.model.dirty, 5);  /* dirty increments per character */
+    ASSERT_EQ(ctx.model.dirty, 1);  /* One bulk edit */
 
     /* Cleanup */
     free_ctx_with_lua(&ctx);
 }
 
+/* Test loki.delete_text() function */
+TEST(lua_delete_text_removes_range) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+
+    editor_insert_text(&ctx, "one\ntwo\nthree", 13);
+    int dirty = ctx.model.dirty;
+
+    /* From "one" after 'o' to "three" before 'e': one splice */
+    int result = luaL_dostring(ctx_L(&ctx), "return loki.delete_text(0, 1, 2, 3)");
+    ASSERT_EQ(result, 0);
+    ASSERT_EQ((int)lua_tointeger(ctx_L(&ctx), -1), 10);
+    lua_pop(ctx_L(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oee");
+    ASSERT_EQ(ctx.model.dirty, dirty + 1);
+    ASSERT_EQ(ctx.view.cy, 0);
+    ASSERT_EQ(ctx.view.cx, 1);
+
+    free_ctx_with_lua(&ctx);
+}
+
 /* Test loki.get_filename() function */
 TEST(lua_get_filename_returns_name) {
     editor_ctx_t ctx;
@@ -296,6 +400,384 @@ TEST(lua_register_language_adds_syntax) {
     free_ctx_with_lua(&ctx);
 }
 
+/* Test loki.buffer() on the editor context */
+TEST(lua_buffer_reads_rows) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    char rows[][16] = { "alpha", "beta 42", "gamma" };
+    for (int i = 0; i < 3; i++)
+        editor_insert_row(&ctx, i, rows[i], strlen(rows[i]));
+
+    lua_State *L = ctx_L(&ctx);
+    ASSERT_EQ(luaL_dostring(L, "local b = loki.buffer()\n"
+                               "return #b, b:line(1), b:line(3)"), 0);
+    ASSERT_EQ(lua_tointeger(L, -3), 3);
+    ASSERT_STR_EQ(lua_tostring(L, -2), "beta 42");
+    ASSERT_TRUE(lua_isnil(L, -1));
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "local t = {}\n"
+                               "for r, s in loki.buffer():lines(1) do t[#t + 1] = r .. '=' .. s end\n"
+                               "return table.concat(t, ',')"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "1=beta 42,2=gamma");
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "return loki.buffer():find('[0-9]+')"), 0);
+    ASSERT_EQ(lua_tointeger(L, -3), 1);
+    ASSERT_EQ(lua_tointeger(L, -2), 5);
+    ASSERT_EQ(lua_tointeger(L, -1), 2);
+    lua_settop(L, 0);
+
+    /* Pointers at the rows themselves, clamped to the buffer */
+    struct { const char *data; size_t len; } *slices;
+    ASSERT_EQ(luaL_dostring(L, "buf = loki.buffer(); return buf:slices(1, 5)"), 0);
+    ASSERT_EQ(lua_tointeger(L, -1), 2);
+    slices = lua_touserdata(L, -2);
+    ASSERT_NOT_NULL(slices);
+    ASSERT_TRUE(slices[0].data == ctx.model.row[1].chars);
+    ASSERT_EQ((int)slices[0].len, 7);
+    ASSERT_TRUE(slices[1].data == ctx.model.row[2].chars);
+    ASSERT_EQ((int)slices[1].len, 5);
+    lua_settop(L, 0);
+
+    /* No such buffer */
+    ASSERT_EQ(luaL_dostring(L, "return loki.buffer(999)"), 0);
+    ASSERT_TRUE(lua_isnil(L, -1));
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test a loki.buffer() handle on a buffer closed since */
+TEST(lua_buffer_errors_once_closed) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    int id = buffer_create(NULL);
+    ASSERT_TRUE(id > 0);
+    char row[] = "text";
+    editor_insert_row(buffer_get(id), 0, row, strlen(row));
+
+    lua_State *L = ctx_L(&ctx);
+    char chunk[64];
+    snprintf(chunk, sizeof(chunk), "buf = loki.buffer(%d); return buf:line(0)", id);
+    ASSERT_EQ(luaL_dostring(L, chunk), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "text");
+    lua_settop(L, 0);
+
+    ASSERT_EQ(buffer_close(id, 1), 0);
+    ASSERT_EQ(luaL_dostring(L, "return pcall(function() return buf:line(0) end)"), 0);
+    ASSERT_FALSE(lua_toboolean(L, -2));
+    ASSERT_TRUE(strstr(lua_tostring(L, -1), "closed") != NULL);
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "buf = nil; collectgarbage()"), 0);
+    buffers_free();
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test a key mapped with loki.keymap() reaching its callback */
+TEST(lua_keymap_dispatches_by_mode) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    char row[] = "abc";
+    editor_insert_row(&ctx, 0, row, strlen(row));
+
+    lua_State *L = ctx_L(&ctx);
+    ASSERT_EQ(luaL_dostring(L, "hits = 0\n"
+                               "loki.keymap('n', 'l', function() hits = hits + 1 end)\n"
+                               "loki.keymap('i', 'x', function() hits = hits + 10 end)"), 0);
+
+    /* The mapping replaces the motion */
+    modal_process_normal_mode_key(&ctx, 0, 'l');
+    ASSERT_EQ(ctx.view.cx, 0);
+    lua_getglobal(L, "hits");
+    ASSERT_EQ(lua_tointeger(L, -1), 1);
+    lua_settop(L, 0);
+
+    /* Other modes' mappings and unmapped keys aren't called */
+    modal_process_normal_mode_key(&ctx, 0, 'x');
+    ASSERT_EQ(ctx.model.row[0].size, 2);
+    lua_getglobal(L, "hits");
+    ASSERT_EQ(lua_tointeger(L, -1), 1);
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "loki.keyunmap('n', 'l')"), 0);
+    modal_process_normal_mode_key(&ctx, 0, 'l');
+    ASSERT_EQ(ctx.view.cx, 1);
+    lua_getglobal(L, "hits");
+    ASSERT_EQ(lua_tointeger(L, -1), 1);
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test the callback a key was mapped to left for the collector once the
+ * key is mapped again or unmapped */
+TEST(lua_keymap_releases_callbacks) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+
+    ASSERT_EQ(luaL_dostring(L,
+        "seen = setmetatable({}, {__mode = 'k'})\n"
+        "local function map(modes, key)\n"
+        "    local f = function() end\n"
+        "    seen[f] = true\n"
+        "    loki.keymap(modes, key, f)\n"
+        "end\n"
+        "function live()\n"
+        "    collectgarbage(); collectgarbage()\n"
+        "    local n = 0\n"
+        "    for _ in pairs(seen) do n = n + 1 end\n"
+        "    return n\n"
+        "end\n"
+        "map('ni', 'Q')\n"
+        "map('n', 'Q')"), 0);
+
+    /* The first still mapped in insert mode */
+    ASSERT_EQ(luaL_dostring(L, "return live()"), 0);
+    ASSERT_EQ(lua_tointeger(L, -1), 2);
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "loki.keyunmap('i', 'Q'); return live()"), 0);
+    ASSERT_EQ(lua_tointeger(L, -1), 1);
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "loki.keyunmap('n', 'Q'); return live()"), 0);
+    ASSERT_EQ(lua_tointeger(L, -1), 0);
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test loki.await() on an operation that calls back before returning */
+TEST(lua_await_answered_at_once) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+
+    ASSERT_EQ(luaL_dostring(L,
+        "local co = loki.async(function(x)\n"
+        "    local a, b = loki.await(function(n, cb) cb(n + 1, 'now') end, x)\n"
+        "    result = a .. b\n"
+        "end, 1)\n"
+        "return coroutine.status(co)"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "dead");
+    lua_getglobal(L, "result");
+    ASSERT_STR_EQ(lua_tostring(L, -1), "2now");
+    lua_settop(L, 0);
+
+    /* Outside a coroutine it is an error */
+    ASSERT_NEQ(luaL_dostring(L, "loki.await(function(cb) cb() end)"), 0);
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test loki.await() resumed when its callback is called later, once */
+TEST(lua_await_resumed_later) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+
+    ASSERT_EQ(luaL_dostring(L,
+        "results = {}\n"
+        "co = loki.async(function()\n"
+        "    results[#results + 1] = loki.await(function(cb) resume = cb end)\n"
+        "    results[#results + 1] = loki.await(function(cb) resume = cb end)\n"
+        "end)\n"
+        "return coroutine.status(co), #results"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -2), "suspended");
+    ASSERT_EQ(lua_tointeger(L, -1), 0);
+    lua_settop(L, 0);
+
+    /* A callback called twice resumes once */
+    ASSERT_EQ(luaL_dostring(L, "local cb = resume; cb(5); cb(6)\n"
+                               "return coroutine.status(co), #results, results[1]"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -3), "suspended");
+    ASSERT_EQ(lua_tointeger(L, -2), 1);
+    ASSERT_EQ(lua_tointeger(L, -1), 5);
+    lua_settop(L, 0);
+
+    ASSERT_EQ(luaL_dostring(L, "resume(7); return coroutine.status(co), results[2]"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -2), "dead");
+    ASSERT_EQ(lua_tointeger(L, -1), 7);
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test loki.sleep() resuming from the main loop's timers */
+TEST(lua_sleep_resumes_from_timer) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+
+    ASSERT_EQ(luaL_dostring(L,
+        "co = loki.async(function() loki.sleep(1); slept = true end)\n"
+        "return slept"), 0);
+    ASSERT_TRUE(lua_isnil(L, -1));
+    lua_settop(L, 0);
+
+    for (int tries = 0; tries < 100; tries++) {
+        struct timespec ts = {0, 2000000};
+        nanosleep(&ts, NULL);
+        timer_service_run();
+        async_queue_dispatch_all(NULL, &ctx);
+        lua_getglobal(L, "slept");
+        int slept = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (slept) break;
+    }
+    ASSERT_EQ(luaL_dostring(L, "return slept, coroutine.status(co)"), 0);
+    ASSERT_TRUE(lua_toboolean(L, -2));
+    ASSERT_STR_EQ(lua_tostring(L, -1), "dead");
+    lua_settop(L, 0);
+
+    free_ctx_with_lua(&ctx);
+    timer_service_cleanup();
+    async_queue_cleanup();
+}
+
+/* Test lua_profile_pcall() timing its entry point, and the sampler */
+TEST(lua_profile_times_entries_and_samples) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+    lua_profile_reset();
+
+    ASSERT_EQ(luaL_dostring(L,
+        "function busy()\n"
+        "    local s = 0\n"
+        "    for i = 1, 200000 do s = s + i % 7 end\n"
+        "    return s\n"
+        "end\n"
+        "function fails() error('no') end"), 0);
+    lua_getglobal(L, "busy");
+    ASSERT_EQ(lua_profile_pcall(L, LUA_PROFILE_TIMER, 0, 1), LUA_OK);
+    lua_getglobal(L, "fails");
+    ASSERT_NEQ(lua_profile_pcall(L, LUA_PROFILE_TIMER, 0, 1), LUA_OK);
+    lua_settop(L, 0);
+
+    LuaProfileEntryStats st;
+    lua_profile_get_entry(LUA_PROFILE_TIMER, &st);
+    ASSERT_EQ((int)st.calls, 2);
+    ASSERT_EQ((int)st.errors, 1);
+    ASSERT_TRUE(st.max_ns > 0 && st.total_ns >= st.max_ns);
+    lua_profile_get_entry(LUA_PROFILE_KEYMAP, &st);
+    ASSERT_EQ((int)st.calls, 0);
+
+    /* One state sampled at a time */
+    ASSERT_EQ(lua_profile_start(L, 100), 0);
+    ASSERT_TRUE(lua_profile_running());
+    lua_State *other = luaL_newstate();
+    ASSERT_EQ(lua_profile_start(other, 100), -1);
+    lua_close(other);
+
+    lua_getglobal(L, "busy");
+    ASSERT_EQ(lua_profile_pcall(L, LUA_PROFILE_KEYMAP, 0, 1), LUA_OK);
+    lua_settop(L, 0);
+    lua_profile_stop();
+    ASSERT_FALSE(lua_profile_running());
+    ASSERT_TRUE(lua_profile_samples() > 0);
+
+    LuaProfileFunc top[4];
+    ASSERT_TRUE(lua_profile_top(top, 4) >= 1);
+    ASSERT_TRUE(strncmp(top[0].name, "busy@", 5) == 0);
+
+    /* Folded stacks, under the entry point they came from */
+    const char *path = "/tmp/loki_lua_profile.folded";
+    ASSERT_TRUE(lua_profile_write_folded(path) >= 1);
+    FILE *fp = fopen(path, "r");
+    ASSERT_NOT_NULL(fp);
+    char line[512];
+    int busy = 0;
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "keymap;", 7) == 0 && strstr(line, ";busy@")) busy = 1;
+    fclose(fp);
+    unlink(path);
+    ASSERT_TRUE(busy);
+
+    lua_profile_reset();
+    ASSERT_EQ((int)lua_profile_samples(), 0);
+    free_ctx_with_lua(&ctx);
+}
+
+/* Test the collector stepped in idle time, and stopped for bursts */
+TEST(lua_gc_scheduled_around_input) {
+    editor_ctx_t ctx;
+    init_ctx_with_lua(&ctx);
+    lua_State *L = ctx_L(&ctx);
+    LuaGcStats st;
+    const char *garbage = "collectgarbage('stop')\n"
+                          "for i = 1, 20000 do local t = { i, tostring(i) } end\n"
+                          "collectgarbage('restart')";
+
+    /* Idle: the first period takes the heap's measure, the next pays
+     * for what was allocated since */
+    lua_gc_set_mode(LUA_GC_IDLE);
+    lua_gc_reset_stats();
+    lua_gc_idle(L, 0);
+    ASSERT_EQ(luaL_dostring(L, garbage), 0);
+    lua_gc_idle(L, 0);
+    lua_gc_get_stats(&st);
+    ASSERT_EQ((int)st.idle_runs, 1);
+    ASSERT_TRUE(st.steps > 0);
+
+    /* No bursts but in burst mode */
+    lua_gc_input(L);
+    lua_gc_get_stats(&st);
+    ASSERT_EQ((int)st.bursts, 0);
+
+    /* Burst: stopped by input, started again by the next idle period */
+    lua_gc_set_mode(LUA_GC_BURST);
+    lua_gc_input(L);
+    lua_gc_input(L);
+    lua_gc_get_stats(&st);
+    ASSERT_EQ((int)st.bursts, 1);
+#ifdef LUA_GCISRUNNING
+    ASSERT_EQ(lua_gc(L, LUA_GCISRUNNING, 0), 0);
+#endif
+    lua_gc_idle(L, 0);
+#ifdef LUA_GCISRUNNING
+    ASSERT_NEQ(lua_gc(L, LUA_GCISRUNNING, 0), 0);
+#endif
+
+    /* Started again mid-burst past the growth limit, and not stopped
+     * again until the burst is over */
+    lua_gc_set_burst_limit(64 * 1024);
+    lua_gc_input(L);
+    ASSERT_EQ(luaL_dostring(L, "hold = {}\n"
+                               "for i = 1, 2000 do hold[i] = string.rep('x', 256) .. i end"), 0);
+    lua_gc_input(L);
+    lua_gc_input(L);
+    lua_gc_get_stats(&st);
+    ASSERT_EQ((int)st.bursts, 2);
+    ASSERT_EQ((int)st.overflows, 1);
+#ifdef LUA_GCISRUNNING
+    ASSERT_NEQ(lua_gc(L, LUA_GCISRUNNING, 0), 0);
+#endif
+
+    /* Auto: left to Lua */
+    lua_gc_set_mode(LUA_GC_AUTO);
+    lua_gc_idle(L, 0);
+    lua_gc_input(L);
+    lua_gc_get_stats(&st);
+    ASSERT_EQ((int)st.bursts, 2);
+
+    ASSERT_EQ(luaL_dostring(L, "return loki.gc_stats().mode"), 0);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "auto");
+    lua_settop(L, 0);
+
+    lua_gc_set_mode(LUA_GC_BURST);
+    lua_gc_set_burst_limit(LUA_GC_BURST_LIMIT);
+    lua_gc_forget(L);
+    free_ctx_with_lua(&ctx);
+}
+
 /* Test Lua error handling */
 TEST(lua_handles_syntax_errors) {
     editor_ctx_t ctx;
@@ -324,11 +806,23 @@ BEGIN_TEST_SUITE("Lua API Integration")
     RUN_TEST(lua_get_lines_returns_count);
     RUN_TEST(lua_get_line_returns_content);
     RUN_TEST(lua_get_line_handles_out_of_bounds);
+    RUN_TEST(lua_search_finds_regex_and_literal_matches);
+    RUN_TEST(lua_grep_returns_matches_across_files);
     RUN_TEST(lua_get_cursor_returns_position);
     RUN_TEST(lua_insert_text_adds_content);
+    RUN_TEST(lua_delete_text_removes_range);
     RUN_TEST(lua_get_filename_returns_name);
     RUN_TEST(lua_get_filename_returns_nil_when_no_file);
     RUN_TEST(lua_set_color_updates_colors);
     RUN_TEST(lua_register_language_adds_syntax);
+    RUN_TEST(lua_buffer_reads_rows);
+    RUN_TEST(lua_buffer_errors_once_closed);
+    RUN_TEST(lua_keymap_dispatches_by_mode);
+    RUN_TEST(lua_keymap_releases_callbacks);
+    RUN_TEST(lua_await_answered_at_once);
+    RUN_TEST(lua_await_resumed_later);
+    RUN_TEST(lua_sleep_resumes_from_timer);
+    RUN_TEST(lua_profile_times_entries_and_samples);
+    RUN_TEST(lua_gc_scheduled_around_input);
     RUN_TEST(lua_handles_syntax_errors);
 END_TEST_SUITE()
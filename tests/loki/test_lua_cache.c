@@ -0,0 +1,261 @@
+/* test_lua_cache.c - Unit tests for the Lua bytecode cache
+ *
+ * Tests for:
+ * - A chunk compiled once, then loaded from the cache
+ * - A cache file with another header or version, rebuilt
+ * - A source modified since it was cached, recompiled
+ * - require() through the cache searcher, and falling back to the
+ *   standard searchers for what isn't on package.path
+ *
+ * HOME is pointed at TEST_DIR, where the cache lives in .loki/cache.
+ */
+
+#define _DEFAULT_SOURCE     /* setenv() */
+
+#include "test_framework.h"
+#include "lua_cache.h"
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_lua_cache_test"
+#define TEST_CACHE TEST_DIR "/.loki/cache"
+#define TEST_SCRIPT TEST_DIR "/script.lua"
+#define TEST_MODULE TEST_DIR "/cachedmod.lua"
+
+static void write_file(const char *path, const char *content) {
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fputs(content, f);
+        fclose(f);
+    }
+}
+
+static void setup(void) {
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    mkdir(TEST_DIR "/.loki", 0755);
+    setenv("HOME", TEST_DIR, 1);
+    unsetenv("LOKI_LUA_CACHE");
+    write_file(TEST_SCRIPT, "return 40 + 2\n");
+}
+
+static void teardown(void) {
+    system("rm -rf " TEST_DIR);
+}
+
+static lua_State *new_state(void) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    return L;
+}
+
+/* Load TEST_SCRIPT through the cache and run it: 42, or -1 */
+static int run_script(lua_State *L) {
+    if (lua_cache_dofile(L, TEST_SCRIPT) != LUA_OK) {
+        lua_pop(L, 1);
+        return -1;
+    }
+    int v = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+/* Path of the one cache file in TEST_CACHE ("" if there is none) */
+static void cache_path(char *path, size_t size) {
+    path[0] = '\0';
+    DIR *d = opendir(TEST_CACHE);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (strstr(e->d_name, ".luac"))
+            snprintf(path, size, "%s/%s", TEST_CACHE, e->d_name);
+    closedir(d);
+}
+
+TEST(compiled_once_then_cached) {
+    setup();
+    lua_State *L = new_state();
+    LuaCacheStats before, after;
+
+    lua_cache_get_stats(&before);
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.misses - before.misses, 1);
+    ASSERT_EQ(after.stores - before.stores, 1);
+
+    char path[512];
+    cache_path(path, sizeof(path));
+    ASSERT_TRUE(path[0] != '\0');
+
+    before = after;
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 1);
+    ASSERT_EQ(after.misses - before.misses, 0);
+
+    lua_close(L);
+    teardown();
+}
+
+TEST(header_mismatch_rebuilt) {
+    setup();
+    lua_State *L = new_state();
+    LuaCacheStats before, after;
+    ASSERT_EQ(run_script(L), 42);
+
+    /* Another cache format version, in place */
+    char path[512];
+    cache_path(path, sizeof(path));
+    int fd = open(path, O_WRONLY);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_EQ(pwrite(fd, "9", 1, strlen("LOKILUAC ")), 1);
+    close(fd);
+
+    lua_cache_get_stats(&before);
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 0);
+    ASSERT_EQ(after.misses - before.misses, 1);
+    ASSERT_EQ(after.stores - before.stores, 1);
+
+    /* Garbage after a good header: the runtime refuses it */
+    FILE *f = fopen(path, "rb");
+    ASSERT_NOT_NULL(f);
+    char header[1024];
+    size_t header_len = 0;
+    for (int lines = 0; lines < 3 && header_len < sizeof(header); ) {
+        int c = fgetc(f);
+        if (c == EOF) break;
+        header[header_len++] = (char)c;
+        if (c == '\n') lines++;
+    }
+    fclose(f);
+    f = fopen(path, "wb");
+    ASSERT_NOT_NULL(f);
+    fwrite(header, 1, header_len, f);
+    fputs("not bytecode at all", f);
+    fclose(f);
+
+    before = after;
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 0);
+    ASSERT_EQ(after.misses - before.misses, 1);
+
+    /* And the rebuilt one is used */
+    before = after;
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 1);
+
+    lua_close(L);
+    teardown();
+}
+
+TEST(stale_source_recompiled) {
+    setup();
+    lua_State *L = new_state();
+    LuaCacheStats before, after;
+    ASSERT_EQ(run_script(L), 42);
+
+    /* Same size, new content and mtime */
+    write_file(TEST_SCRIPT, "return 40 + 3\n");
+    struct timespec times[2] = { {0, UTIME_OMIT}, {2000000000, 0} };
+    ASSERT_EQ(utimensat(AT_FDCWD, TEST_SCRIPT, times, 0), 0);
+
+    lua_cache_get_stats(&before);
+    ASSERT_EQ(run_script(L), 43);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 0);
+    ASSERT_EQ(after.misses - before.misses, 1);
+
+    lua_close(L);
+    teardown();
+}
+
+TEST(disabled_by_environment) {
+    setup();
+    setenv("LOKI_LUA_CACHE", "0", 1);
+    lua_State *L = new_state();
+    LuaCacheStats before, after;
+
+    lua_cache_get_stats(&before);
+    ASSERT_EQ(run_script(L), 42);
+    ASSERT_EQ(run_script(L), 42);
+    lua_cache_get_stats(&after);
+    ASSERT_EQ(after.hits - before.hits, 0);
+    ASSERT_EQ(after.stores - before.stores, 0);
+
+    unsetenv("LOKI_LUA_CACHE");
+    lua_close(L);
+    teardown();
+}
+
+/* require('cachedmod') in a new state: its value, or -1 */
+static int require_module(int *hits) {
+    lua_State *L = new_state();
+    lua_cache_install_searcher(L);
+    luaL_dostring(L, "package.path = '" TEST_DIR "/?.lua'");
+    LuaCacheStats before, after;
+    lua_cache_get_stats(&before);
+    int v = -1;
+    if (luaL_dostring(L, "return require('cachedmod').value") == LUA_OK)
+        v = (int)lua_tointeger(L, -1);
+    lua_cache_get_stats(&after);
+    *hits = (int)(after.hits - before.hits);
+    lua_close(L);
+    return v;
+}
+
+TEST(searcher_loads_through_cache) {
+    setup();
+    write_file(TEST_MODULE, "return { value = 7 }\n");
+    int hits;
+    ASSERT_EQ(require_module(&hits), 7);
+    ASSERT_EQ(hits, 0);
+    ASSERT_EQ(require_module(&hits), 7);
+    ASSERT_EQ(hits, 1);
+    teardown();
+}
+
+TEST(searcher_falls_back) {
+    setup();
+    lua_State *L = new_state();
+    lua_cache_install_searcher(L);
+    luaL_dostring(L, "package.path = '" TEST_DIR "/?.lua'");
+
+    /* Preloaded modules still come first */
+    ASSERT_EQ(luaL_dostring(L,
+        "package.preload.pre = function() return 'preloaded' end\n"
+        "return require('pre')"), LUA_OK);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "preloaded");
+    lua_pop(L, 1);
+
+    /* Not on package.path: the standard searchers' error, where they looked */
+    ASSERT_TRUE(luaL_dostring(L, "return require('nosuchmod')") != LUA_OK);
+    const char *err = lua_tostring(L, -1);
+    ASSERT_NOT_NULL(err);
+    ASSERT_TRUE(strstr(err, "nosuchmod") != NULL);
+    ASSERT_TRUE(strstr(err, TEST_DIR "/nosuchmod.lua") != NULL);
+    lua_pop(L, 1);
+
+    lua_close(L);
+    teardown();
+}
+
+BEGIN_TEST_SUITE("lua_cache")
+    RUN_TEST(compiled_once_then_cached);
+    RUN_TEST(header_mismatch_rebuilt);
+    RUN_TEST(stale_source_recompiled);
+    RUN_TEST(disabled_by_environment);
+    RUN_TEST(searcher_loads_through_cache);
+    RUN_TEST(searcher_falls_back);
+END_TEST_SUITE()
@@ -0,0 +1,225 @@
+/* test_lua_worker.c - Unit tests for Lua run off the main thread
+ *
+ * Tests for:
+ * - Values copied between states: scalars, strings with NULs, nested
+ *   tables
+ * - Values that can't be copied: functions, cycles
+ * - A job spawned, its messages and its result (or error) delivered as
+ *   LUA_WORKER_ASYNC_EVENT events
+ */
+
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
+#include "test_framework.h"
+#include "lua_worker.h"
+#include "async_queue.h"
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static lua_State *new_state(void) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    return L;
+}
+
+/* Copy the value 'expr' evaluates to from one state to another, leaving
+ * it on top of 'to'. Returns lua_worker_encode()'s result. */
+static int copy_value(lua_State *from, lua_State *to, const char *expr) {
+    char chunk[256];
+    snprintf(chunk, sizeof(chunk), "return %s", expr);
+    if (luaL_dostring(from, chunk) != LUA_OK) return -2;
+    LuaWorkerValue v = {NULL, 0, 0};
+    int rc = lua_worker_encode(from, -1, 1, &v);
+    if (rc == 0) lua_worker_decode(to, v.data, v.len);
+    lua_worker_value_free(&v);
+    lua_settop(from, 0);
+    return rc;
+}
+
+TEST(codec_scalars) {
+    lua_State *from = new_state(), *to = new_state();
+
+    LuaWorkerValue v = {NULL, 0, 0};
+    lua_pushnil(from);
+    lua_pushboolean(from, 1);
+    lua_pushboolean(from, 0);
+    lua_pushinteger(from, -1234567890123LL);
+    lua_pushnumber(from, 2.5);
+    lua_pushstring(from, "text");
+    ASSERT_EQ(lua_worker_encode(from, 1, 6, &v), 0);
+    ASSERT_EQ(lua_worker_decode(to, v.data, v.len), 6);
+    lua_worker_value_free(&v);
+
+    ASSERT_TRUE(lua_isnil(to, 1));
+    ASSERT_TRUE(lua_toboolean(to, 2));
+    ASSERT_FALSE(lua_toboolean(to, 3));
+    ASSERT_TRUE(lua_tointeger(to, 4) == -1234567890123LL);
+    ASSERT_TRUE(lua_tonumber(to, 5) == 2.5);
+    ASSERT_STR_EQ(lua_tostring(to, 6), "text");
+
+    lua_close(from);
+    lua_close(to);
+}
+
+TEST(codec_string_with_nuls) {
+    lua_State *from = new_state(), *to = new_state();
+
+    LuaWorkerValue v = {NULL, 0, 0};
+    lua_pushlstring(from, "a\0b\0", 4);
+    ASSERT_EQ(lua_worker_encode(from, -1, 1, &v), 0);
+    ASSERT_EQ(lua_worker_decode(to, v.data, v.len), 1);
+    lua_worker_value_free(&v);
+
+    size_t len;
+    const char *s = lua_tolstring(to, -1, &len);
+    ASSERT_EQ(len, 4);
+    ASSERT_TRUE(memcmp(s, "a\0b\0", 4) == 0);
+
+    lua_close(from);
+    lua_close(to);
+}
+
+TEST(codec_nested_tables) {
+    lua_State *from = new_state(), *to = new_state();
+
+    ASSERT_EQ(copy_value(from, to,
+        "{ 1, 'two', { x = { y = { z = true } } }, name = 'n', [2.5] = false }"), 0);
+    lua_setglobal(to, "t");
+    ASSERT_EQ(luaL_dostring(to,
+        "return t[1] == 1 and t[2] == 'two' and t[3].x.y.z == true\n"
+        "   and t.name == 'n' and t[2.5] == false and #t == 3"), LUA_OK);
+    ASSERT_TRUE(lua_toboolean(to, -1));
+
+    lua_close(from);
+    lua_close(to);
+}
+
+TEST(codec_rejects_functions) {
+    lua_State *from = new_state(), *to = new_state();
+
+    ASSERT_EQ(copy_value(from, to, "function() end"), -1);
+    ASSERT_EQ(copy_value(from, to, "{ f = print }"), -1);
+    ASSERT_EQ(lua_gettop(to), 0);
+
+    /* The message says what couldn't be copied */
+    LuaWorkerValue v = {NULL, 0, 0};
+    lua_pushcfunction(from, luaopen_base);
+    ASSERT_EQ(lua_worker_encode(from, -1, 1, &v), -1);
+    ASSERT_TRUE(strstr(lua_tostring(from, -1), "function") != NULL);
+    lua_worker_value_free(&v);
+
+    lua_close(from);
+    lua_close(to);
+}
+
+TEST(codec_rejects_cycles) {
+    lua_State *from = new_state(), *to = new_state();
+
+    ASSERT_EQ(luaL_dostring(from, "local t = {}; t.self = t; return t"), LUA_OK);
+    LuaWorkerValue v = {NULL, 0, 0};
+    ASSERT_EQ(lua_worker_encode(from, -1, 1, &v), -1);
+    ASSERT_TRUE(strstr(lua_tostring(from, -1), "too deep") != NULL);
+    lua_worker_value_free(&v);
+
+    lua_close(from);
+    lua_close(to);
+}
+
+/* Wait for the next event of job 'id', decoding its values (or error
+ * message) onto 'L'. Returns its LUA_WORKER_EVENT_*, or -1 after a few
+ * seconds. */
+static int next_event(lua_State *L, int id) {
+    for (int tries = 0; tries < 5000; tries++) {
+        AsyncEvent ev;
+        if (async_queue_poll(NULL, &ev) == 0) {
+            int kind = -1;
+            if (ev.type == LUA_WORKER_ASYNC_EVENT && ev.data.user.i64[0] == id) {
+                LuaWorkerReply *reply = ev.data.user.ptr;
+                kind = (int)ev.data.user.i64[1];
+                lua_worker_decode(L, reply->data, reply->len);
+            }
+            async_event_cleanup(&ev);
+            if (kind >= 0) return kind;
+            continue;
+        }
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    return -1;
+}
+
+static int spawn(lua_State *L, const char *source, LuaWorkerValue *args) {
+    const char *error = NULL;
+    return lua_worker_spawn(L, source, strlen(source), args, NULL, &error);
+}
+
+TEST(spawn_returns_result) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    lua_State *L = new_state();
+
+    LuaWorkerValue args = {NULL, 0, 0};
+    lua_pushinteger(L, 20);
+    lua_pushstring(L, "x");
+    ASSERT_EQ(lua_worker_encode(L, 1, 2, &args), 0);
+    lua_settop(L, 0);
+
+    int id = spawn(L,
+        "local n, s = ...\n"
+        "loki.post(s:rep(3))\n"
+        "return n * 2 + 2, { sum = n + 1 }", &args);
+    ASSERT_TRUE(id > 0);
+
+    ASSERT_EQ(next_event(L, id), LUA_WORKER_EVENT_MESSAGE);
+    ASSERT_STR_EQ(lua_tostring(L, -1), "xxx");
+    lua_settop(L, 0);
+
+    ASSERT_EQ(next_event(L, id), LUA_WORKER_EVENT_DONE);
+    ASSERT_EQ(lua_gettop(L), 2);
+    ASSERT_EQ((int)lua_tointeger(L, 1), 42);
+    lua_getfield(L, 2, "sum");
+    ASSERT_EQ((int)lua_tointeger(L, -1), 21);
+    lua_settop(L, 0);
+
+    lua_worker_stop_all();
+    lua_close(L);
+    async_queue_cleanup();
+}
+
+TEST(spawn_reports_error) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    lua_State *L = new_state();
+
+    int id = spawn(L, "error('from the worker')", NULL);
+    ASSERT_TRUE(id > 0);
+    ASSERT_EQ(next_event(L, id), LUA_WORKER_EVENT_ERROR);
+    ASSERT_TRUE(strstr(lua_tostring(L, -1), "from the worker") != NULL);
+    lua_settop(L, 0);
+
+    /* Nothing outside the worker's own libraries */
+    id = spawn(L, "return io == nil and os == nil and require == nil", NULL);
+    ASSERT_TRUE(id > 0);
+    ASSERT_EQ(next_event(L, id), LUA_WORKER_EVENT_DONE);
+    ASSERT_TRUE(lua_toboolean(L, -1));
+    lua_settop(L, 0);
+
+    lua_worker_stop_all();
+    lua_close(L);
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("lua_worker")
+    RUN_TEST(codec_scalars);
+    RUN_TEST(codec_string_with_nuls);
+    RUN_TEST(codec_nested_tables);
+    RUN_TEST(codec_rejects_functions);
+    RUN_TEST(codec_rejects_cycles);
+    RUN_TEST(spawn_returns_result);
+    RUN_TEST(spawn_reports_error);
+END_TEST_SUITE()
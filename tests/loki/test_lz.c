@@ -0,0 +1,80 @@
+/* test_lz.c - Unit tests for the LZ77 compressor
+ *
+ * Tests for:
+ * - Round trips of empty, short, repetitive and incompressible input
+ * - Long literal runs and matches (counts past 15)
+ * - Rejection of malformed input
+ */
+
+#include "test_framework.h"
+#include "lz.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Compress and decompress 'len' bytes; returns the compressed size, or
+ * -1 if they do not come back the same */
+static long round_trip(const char *data, size_t len) {
+    char *packed = malloc(lz_bound(len));
+    char *back = malloc(len + 1);
+    size_t n = lz_compress(data, len, packed);
+    long result = n <= lz_bound(len) &&
+                  lz_decompress(packed, n, back, len) == 0 &&
+                  memcmp(back, data, len) == 0 ? (long)n : -1;
+    free(packed);
+    free(back);
+    return result;
+}
+
+TEST(lz_round_trips_short_input) {
+    ASSERT_EQ(round_trip("", 0), 1);            /* A token alone */
+    ASSERT_EQ(round_trip("a", 1), 2);
+    ASSERT_TRUE(round_trip("abcabc", 6) > 0);
+    ASSERT_TRUE(round_trip("hello, world", 12) > 0);
+}
+
+TEST(lz_shrinks_repetitive_input) {
+    char data[10000];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = "undo entry "[i % 11];
+    long n = round_trip(data, sizeof(data));
+    ASSERT_TRUE(n > 0);
+    ASSERT_TRUE(n < 100);                       /* One long match */
+
+    /* A run of one byte is a match overlapping itself */
+    memset(data, 'x', sizeof(data));
+    ASSERT_TRUE(round_trip(data, sizeof(data)) > 0);
+}
+
+TEST(lz_round_trips_incompressible_input) {
+    char data[5000];
+    unsigned s = 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        s = s * 1103515245u + 12345u;
+        data[i] = (char)(s >> 16);
+    }
+    long n = round_trip(data, sizeof(data));
+    ASSERT_TRUE(n > 0);
+    ASSERT_TRUE((size_t)n <= lz_bound(sizeof(data)));
+}
+
+TEST(lz_rejects_malformed_input) {
+    char out[64];
+    const char *text = "abcdabcdabcdabcd";
+    char packed[64];
+    size_t n = lz_compress(text, 16, packed);
+
+    /* Wrong size, cut short, or a match before the start */
+    ASSERT_EQ(lz_decompress(packed, n, out, 15), -1);
+    ASSERT_EQ(lz_decompress(packed, n, out, 17), -1);
+    ASSERT_EQ(lz_decompress(packed, n - 1, out, 16), -1);
+    ASSERT_EQ(lz_decompress("", 0, out, 0), -1);
+    const char bad[] = { 0x10, 'a', 0x05, 0x00 };
+    ASSERT_EQ(lz_decompress(bad, sizeof(bad), out, 5), -1);
+    ASSERT_EQ(lz_decompress(packed, n, out, 16), 0);
+}
+
+BEGIN_TEST_SUITE("LZ Compressor")
+    RUN_TEST(lz_round_trips_short_input);
+    RUN_TEST(lz_shrinks_repetitive_input);
+    RUN_TEST(lz_round_trips_incompressible_input);
+    RUN_TEST(lz_rejects_malformed_input);
+END_TEST_SUITE()
@@ -0,0 +1,329 @@
+/* test_markdown.c - Unit tests for the Markdown module
+ *
+ * Tests for:
+ * - Parsing, and the rows of extracted headings and links
+ * - The buffer cache's heading and link indexes
+ * - Edits reparsing only the blocks they touch
+ * - Blocks that run on over blank lines (fences, lists) widening a reparse
+ * - Link reference definitions reparsing the whole buffer
+ * - Random edits leaving the cache as a full parse would be
+ * - Rendering only the blocks reparsed since the last render, here or on
+ *   a thread of its own
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "loki_markdown.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static void insert_lines(editor_ctx_t *ctx, const char **lines, int n) {
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, ctx->model.numrows, (char *)lines[i], strlen(lines[i]));
+}
+
+static void set_row(editor_ctx_t *ctx, int at, const char *text) {
+    editor_row_set(ctx, &ctx->model.row[at], text, strlen(text));
+}
+
+/* The buffer parsed in full, and through the cache, render the same */
+static int cache_matches_full_parse(editor_ctx_t *ctx) {
+    size_t len = 0;
+    for (int i = 0; i < ctx->model.numrows; i++) len += (size_t)ctx->model.row[i].size + 1;
+    char *text = malloc(len + 1), *p = text;
+    for (int i = 0; i < ctx->model.numrows; i++) {
+        memcpy(p, ctx->model.row[i].chars, (size_t)ctx->model.row[i].size);
+        p += ctx->model.row[i].size;
+        *p++ = '\n';
+    }
+    loki_markdown_doc *full = loki_markdown_parse(text, len, LOKI_MD_OPT_DEFAULT);
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx->model, LOKI_MD_OPT_DEFAULT);
+    char *want = loki_markdown_render_html(full, LOKI_MD_OPT_DEFAULT);
+    char *got = loki_markdown_render_html(loki_markdown_cache_doc(cache), LOKI_MD_OPT_DEFAULT);
+    int same = strcmp(want, got) == 0;
+
+    /* And the same headings, on the same rows */
+    int nfull, ncached;
+    loki_markdown_heading *heads = loki_markdown_extract_headings(full, &nfull);
+    const loki_markdown_heading *cached = loki_markdown_cache_headings(cache, &ncached);
+    same = same && nfull == ncached;
+    for (int i = 0; same && i < nfull; i++)
+        same = heads[i].level == cached[i].level && heads[i].row == cached[i].row;
+
+    loki_markdown_free_headings(heads, nfull);
+    free(want);
+    free(got);
+    loki_markdown_free(full);
+    free(text);
+    return same;
+}
+
+/* ======================= Parsing ============================================ */
+
+TEST(markdown_extract_rows) {
+    const char *text = "# Title\n\nSee [one](http://a).\n\n## Part `two`\n";
+    loki_markdown_doc *doc = loki_markdown_parse(text, strlen(text), LOKI_MD_OPT_DEFAULT);
+    ASSERT_NOT_NULL(doc);
+
+    int count;
+    loki_markdown_heading *heads = loki_markdown_extract_headings(doc, &count);
+    ASSERT_EQ(count, 2);
+    ASSERT_EQ(heads[0].row, 0);
+    ASSERT_EQ(heads[1].level, 2);
+    ASSERT_EQ(heads[1].row, 4);
+    loki_markdown_free_headings(heads, count);
+
+    loki_markdown_link *links = loki_markdown_extract_links(doc, &count);
+    ASSERT_EQ(count, 1);
+    ASSERT_STR_EQ(links[0].url, "http://a");
+    ASSERT_EQ(links[0].row, 2);
+    loki_markdown_free_links(links, count);
+
+    loki_markdown_free(doc);
+}
+
+/* ======================= Buffer Cache ======================================= */
+
+TEST(markdown_cache_indexes) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"# Title", "", "Text with [a link](http://x \"t\").",
+                           "", "## Part `two`", "- [item](y)"};
+    insert_lines(&ctx, lines, 6);
+
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    int count;
+    const loki_markdown_heading *heads = loki_markdown_cache_headings(cache, &count);
+    ASSERT_EQ(count, 2);
+    ASSERT_STR_EQ(heads[0].text, "Title");
+    ASSERT_EQ(heads[1].level, 2);
+    ASSERT_STR_EQ(heads[1].text, "Part two");
+    ASSERT_EQ(heads[1].row, 4);
+
+    const loki_markdown_link *links = loki_markdown_cache_links(cache, &count);
+    ASSERT_EQ(count, 2);
+    ASSERT_STR_EQ(links[0].text, "a link");
+    ASSERT_STR_EQ(links[0].title, "t");
+    ASSERT_EQ(links[0].row, 2);
+    ASSERT_STR_EQ(links[1].url, "y");
+    ASSERT_EQ(links[1].row, 5);
+    ASSERT_EQ(loki_markdown_count_headings(loki_markdown_cache_doc(cache)), 2);
+
+    /* Got again without edits: nothing parsed */
+    ASSERT_TRUE(loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT) == cache);
+    ASSERT_EQ(loki_markdown_cache_parsed_rows(cache), 0);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(markdown_cache_edit_reparses_its_block) {
+    enum { SECTIONS = 2000 };
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < SECTIONS; i++) {
+        char head[32], para[64];
+        snprintf(head, sizeof(head), "## Section %d", i);
+        snprintf(para, sizeof(para), "Text of %d, [link](u%d).", i, i);
+        const char *lines[] = {head, "", para, ""};
+        insert_lines(&ctx, lines, 4);
+    }
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    ASSERT_EQ(loki_markdown_cache_parsed_rows(cache), SECTIONS * 4);
+
+    /* A paragraph becomes a heading, a row goes in above the next */
+    set_row(&ctx, 4002, "# New heading");
+    editor_insert_row(&ctx, 4004, "More text", 9);
+    cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    ASSERT_TRUE(loki_markdown_cache_parsed_rows(cache) < 10);
+
+    int count;
+    const loki_markdown_heading *heads = loki_markdown_cache_headings(cache, &count);
+    ASSERT_EQ(count, SECTIONS + 1);
+    ASSERT_STR_EQ(heads[1001].text, "New heading");
+    ASSERT_EQ(heads[1001].row, 4002);
+    ASSERT_EQ(heads[1002].row, 4005);       /* Moved down a row */
+    const loki_markdown_link *links = loki_markdown_cache_links(cache, &count);
+    ASSERT_EQ(count, SECTIONS - 1);
+    ASSERT_EQ(links[count - 1].row, SECTIONS * 4 - 1);
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(markdown_cache_fence_widens_reparse) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"# One", "", "text", "", "# Two", "", "- a", "", "- b", "",
+                           "# Three"};
+    insert_lines(&ctx, lines, 11);
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    /* An open fence runs to the end */
+    set_row(&ctx, 2, "```");
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+    int count;
+    loki_markdown_cache_headings(loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT), &count);
+    ASSERT_EQ(count, 1);
+
+    /* And a closed one stops again */
+    set_row(&ctx, 5, "```");
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    /* An item joins the list over the blank line */
+    set_row(&ctx, 2, "text");
+    set_row(&ctx, 5, "");
+    editor_insert_row(&ctx, 10, "- c", 3);
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(markdown_cache_reference_definitions) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"See [x].", "", "# Head", "", "text"};
+    insert_lines(&ctx, lines, 5);
+
+    int count;
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    loki_markdown_cache_links(cache, &count);
+    ASSERT_EQ(count, 0);
+
+    /* A definition far below makes the link */
+    set_row(&ctx, 4, "[x]: http://x");
+    cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    const loki_markdown_link *links = loki_markdown_cache_links(cache, &count);
+    ASSERT_EQ(count, 1);
+    ASSERT_STR_EQ(links[0].url, "http://x");
+    ASSERT_EQ(loki_markdown_cache_parsed_rows(cache), 5);
+
+    editor_del_row(&ctx, 4);
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(markdown_cache_random_edits) {
+    static const char *pool[] = {
+        "# Head", "Setext", "===", "---", "", "", "text [l](u)", "more text",
+        "- item", "  continued", "1. first", "    code", "```", "~~~", "> quote",
+        "<div>", "</div>", "<!-- note", "-->", "***", "\t- tab item",
+    };
+    enum { POOL = sizeof(pool) / sizeof(pool[0]) };
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    srand(7);
+    for (int i = 0; i < 200; i++) {
+        const char *line = pool[rand() % POOL];
+        editor_insert_row(&ctx, i, (char *)line, strlen(line));
+    }
+    ASSERT_TRUE(cache_matches_full_parse(&ctx));
+
+    for (int step = 0; step < 400; step++) {
+        const char *line = pool[rand() % POOL];
+        int at = rand() % ctx.model.numrows;
+        switch (rand() % 4) {
+        case 0: editor_insert_row(&ctx, at, (char *)line, strlen(line)); break;
+        case 1: if (ctx.model.numrows > 1) editor_del_row(&ctx, at); break;
+        case 2: set_row(&ctx, at, line); break;
+        default: {
+            /* Several edits before the next look */
+            int end = at + rand() % 4;
+            if (end >= ctx.model.numrows) end = ctx.model.numrows - 1;
+            editor_replace_range(&ctx, at, 0, end, 0, "x\n\n- y\n", 7, NULL, NULL);
+            set_row(&ctx, rand() % ctx.model.numrows, line);
+        }
+        }
+        if (!cache_matches_full_parse(&ctx)) {
+            printf("    mismatch after step %d\n", step);
+            ASSERT_TRUE(0);
+        }
+    }
+    editor_ctx_free(&ctx);
+}
+
+/* ======================= Rendering ========================================== */
+
+TEST(markdown_cache_renders_changed_blocks) {
+    enum { SECTIONS = 500 };
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < SECTIONS; i++) {
+        char head[32];
+        snprintf(head, sizeof(head), "## Section %d", i);
+        const char *lines[] = {head, "", "Some *text*.", ""};
+        insert_lines(&ctx, lines, 4);
+    }
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    char *html = loki_markdown_cache_render_html(cache, LOKI_MD_OPT_DEFAULT);
+    char *want = loki_markdown_render_html(loki_markdown_cache_doc(cache), LOKI_MD_OPT_DEFAULT);
+    ASSERT_STR_EQ(html, want);
+    ASSERT_EQ(loki_markdown_cache_rendered_blocks(cache), SECTIONS * 2);
+    free(html);
+    free(want);
+
+    unsigned long edits = loki_markdown_cache_edits(&ctx.model);
+    set_row(&ctx, 1002, "A `changed` paragraph.");
+    ASSERT_TRUE(loki_markdown_cache_edits(&ctx.model) != edits);
+    cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    html = loki_markdown_cache_render_html(cache, LOKI_MD_OPT_DEFAULT);
+    ASSERT_TRUE(loki_markdown_cache_rendered_blocks(cache) < 4);
+    ASSERT_NOT_NULL(strstr(html, "<p>A <code>changed</code> paragraph.</p>"));
+    want = loki_markdown_render_html(loki_markdown_cache_doc(cache), LOKI_MD_OPT_DEFAULT);
+    ASSERT_STR_EQ(html, want);
+    free(html);
+    free(want);
+
+    /* Other options render every block again */
+    html = loki_markdown_cache_render_html(cache, LOKI_MD_OPT_SMART);
+    ASSERT_EQ(loki_markdown_cache_rendered_blocks(cache), SECTIONS * 2);
+    free(html);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(markdown_cache_renders_on_a_thread) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"# Title", "", "- one", "- two"};
+    insert_lines(&ctx, lines, 4);
+
+    loki_markdown_cache *cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    char *html = NULL;
+    ASSERT_EQ(loki_markdown_cache_render_poll(cache, &html), -1);
+    ASSERT_EQ(loki_markdown_cache_render_start(cache, LOKI_MD_OPT_DEFAULT), 0);
+    int got;
+    while ((got = loki_markdown_cache_render_poll(cache, &html)) == 0) {}
+    ASSERT_EQ(got, 1);
+    ASSERT_NOT_NULL(strstr(html, "<h1>Title</h1>"));
+    ASSERT_NOT_NULL(strstr(html, "<li>two</li>"));
+    free(html);
+
+    /* An edit while it runs waits for the next */
+    ASSERT_EQ(loki_markdown_cache_render_start(cache, LOKI_MD_OPT_DEFAULT), 0);
+    set_row(&ctx, 0, "# Retitled");
+    cache = loki_markdown_cache_get(&ctx.model, LOKI_MD_OPT_DEFAULT);
+    ASSERT_EQ(loki_markdown_cache_render_poll(cache, &html), 1);
+    ASSERT_NOT_NULL(strstr(html, "<h1>Title</h1>"));
+    free(html);
+    html = loki_markdown_cache_render_html(cache, LOKI_MD_OPT_DEFAULT);
+    ASSERT_NOT_NULL(strstr(html, "<h1>Retitled</h1>"));
+    free(html);
+
+    /* Freed, with a render running */
+    ASSERT_EQ(loki_markdown_cache_render_start(cache, LOKI_MD_OPT_DEFAULT), 0);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Markdown")
+    RUN_TEST(markdown_extract_rows);
+    RUN_TEST(markdown_cache_indexes);
+    RUN_TEST(markdown_cache_edit_reparses_its_block);
+    RUN_TEST(markdown_cache_fence_widens_reparse);
+    RUN_TEST(markdown_cache_reference_definitions);
+    RUN_TEST(markdown_cache_random_edits);
+    RUN_TEST(markdown_cache_renders_changed_blocks);
+    RUN_TEST(markdown_cache_renders_on_a_thread);
+END_TEST_SUITE()
@@ -0,0 +1,175 @@
+/* test_marks.c - Unit tests for edit-stable marks
+ *
+ * Tests for:
+ * - Adding, reading, moving and deleting marks by id
+ * - Marks following inserted and deleted text and lines
+ * - Gravity at an insert, and marks inside replaced text
+ * - Many marks and edits against a plain array of positions
+ * - Buffer edits moving the buffer's marks
+ */
+
+#include "test_framework.h"
+#include "marks.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int mark_row(MarkSet *set, int id) {
+    int row, col;
+    return marks_get(set, id, &row, &col) == 0 ? row : -1;
+}
+
+static int mark_col(MarkSet *set, int id) {
+    int row, col;
+    return marks_get(set, id, &row, &col) == 0 ? col : -1;
+}
+
+TEST(marks_are_found_by_id) {
+    MarkSet *set = marks_new();
+    ASSERT_NOT_NULL(set);
+    int a = marks_add(set, 5, 3, 0);
+    int b = marks_add(set, 2, 0, 0);
+    ASSERT_TRUE(a > 0 && b > 0 && a != b);
+    ASSERT_EQ(marks_add(set, -1, 0, 0), -1);
+    ASSERT_EQ(marks_count(set), 2);
+    ASSERT_EQ(mark_row(set, a), 5);
+    ASSERT_EQ(mark_col(set, a), 3);
+
+    ASSERT_EQ(marks_move(set, b, 9, 1), 0);
+    ASSERT_EQ(mark_row(set, b), 9);
+    marks_del(set, a);
+    ASSERT_EQ(mark_row(set, a), -1);
+    ASSERT_EQ(marks_count(set), 1);
+
+    /* A deleted id is handed out again */
+    ASSERT_EQ(marks_add(set, 0, 0, 0), a);
+    marks_free(set);
+}
+
+TEST(marks_follow_edits) {
+    MarkSet *set = marks_new();
+    int ids[100];
+    for (int row = 0; row < 100; row++) ids[row] = marks_add(set, row, 4, 0);
+
+    /* Typed before the mark on row 10, after the one on row 11 */
+    marks_note_edit(set, 10, 1, 10, 1, 10, 3);
+    marks_note_edit(set, 11, 6, 11, 6, 11, 7);
+    ASSERT_EQ(mark_col(set, ids[10]), 6);
+    ASSERT_EQ(mark_col(set, ids[11]), 4);
+
+    /* Three lines inserted above row 20 */
+    marks_note_edit(set, 20, 0, 20, 0, 23, 0);
+    ASSERT_EQ(mark_row(set, ids[19]), 19);
+    ASSERT_EQ(mark_row(set, ids[20]), 23);
+    ASSERT_EQ(mark_row(set, ids[99]), 102);
+
+    /* Rows 50-59 deleted: their marks go to where they were */
+    marks_note_edit(set, 50, 0, 60, 0, 50, 0);
+    ASSERT_EQ(mark_row(set, ids[46]), 49);
+    ASSERT_EQ(mark_row(set, ids[47]), 50);
+    ASSERT_EQ(mark_col(set, ids[47]), 0);
+    ASSERT_EQ(mark_row(set, ids[57]), 50);
+    ASSERT_EQ(mark_col(set, ids[57]), 4);
+    ASSERT_EQ(marks_count(set), 100);
+
+    /* A row split before the mark takes it to the new row */
+    marks_note_edit(set, 5, 2, 5, 2, 6, 0);
+    ASSERT_EQ(mark_row(set, ids[5]), 6);
+    ASSERT_EQ(mark_col(set, ids[5]), 2);
+    ASSERT_EQ(mark_row(set, ids[6]), 7);
+    ASSERT_EQ(mark_col(set, ids[6]), 4);
+
+    marks_free(set);
+}
+
+TEST(marks_gravity_at_an_insert) {
+    MarkSet *set = marks_new();
+    int left = marks_add(set, 0, 4, 0);
+    int right = marks_add(set, 0, 4, 1);
+    int inside = marks_add(set, 1, 5, 1);
+
+    marks_note_edit(set, 0, 4, 0, 4, 0, 7);
+    ASSERT_EQ(mark_col(set, left), 4);
+    ASSERT_EQ(mark_col(set, right), 7);
+
+    /* Replacing [2, 8) of row 1 with two lines */
+    marks_note_edit(set, 1, 2, 1, 8, 2, 3);
+    ASSERT_EQ(mark_row(set, inside), 2);
+    ASSERT_EQ(mark_col(set, inside), 3);
+    marks_free(set);
+}
+
+/* The same positions kept in an array, moved one by one */
+static void naive_edit(int *row, int *col, const int *grav, int n,
+                       int sr, int sc, int orow, int oc, int nr, int nc) {
+    for (int i = 0; i < n; i++) {
+        int at_start = row[i] == sr && col[i] == sc;
+        int inside = (row[i] > sr || (row[i] == sr && col[i] >= sc)) &&
+                     (row[i] < orow || (row[i] == orow && col[i] < oc));
+        if (at_start || inside) {
+            if (!inside && !grav[i]) continue;
+            row[i] = grav[i] ? nr : sr;
+            col[i] = grav[i] ? nc : sc;
+        } else if (row[i] == orow && col[i] >= oc) {
+            row[i] = nr;
+            col[i] += nc - oc;
+        } else if (row[i] > orow) {
+            row[i] += nr - orow;
+        }
+    }
+}
+
+TEST(marks_match_positions_moved_one_by_one) {
+    enum { N = 300 };
+    int ids[N], row[N], col[N], grav[N];
+    MarkSet *set = marks_new();
+    srand(7);
+    for (int i = 0; i < N; i++) {
+        row[i] = rand() % 40;
+        col[i] = rand() % 20;
+        grav[i] = rand() % 2;
+        ids[i] = marks_add(set, row[i], col[i], grav[i]);
+    }
+    for (int e = 0; e < 2000; e++) {
+        int sr = rand() % 40, sc = rand() % 20;
+        int orow = sr + (rand() % 4 == 0 ? rand() % 3 : 0);
+        int oc = orow == sr ? sc + rand() % 4 : rand() % 20;
+        int nr = sr + (rand() % 4 == 0 ? rand() % 3 : 0);
+        int nc = nr == sr ? sc + rand() % 4 : rand() % 20;
+        marks_note_edit(set, sr, sc, orow, oc, nr, nc);
+        naive_edit(row, col, grav, N, sr, sc, orow, oc, nr, nc);
+    }
+    for (int i = 0; i < N; i++) {
+        ASSERT_EQ(mark_row(set, ids[i]), row[i]);
+        ASSERT_EQ(mark_col(set, ids[i]), col[i]);
+    }
+    marks_free(set);
+}
+
+TEST(buffer_edits_move_its_marks) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, "one", 3);
+    editor_insert_row(&ctx, 1, "two", 3);
+    int id = editor_mark_add(&ctx.model, 1, 2, 0);
+    ASSERT_TRUE(id > 0);
+
+    editor_insert_row(&ctx, 0, "zero", 4);
+    ASSERT_EQ(mark_row(ctx.model.marks, id), 2);
+    ctx.view.cx = 0;
+    ctx.view.cy = 2;
+    editor_insert_char(&ctx, 'x');
+    ASSERT_EQ(mark_col(ctx.model.marks, id), 3);
+
+    editor_del_row(&ctx, 0);
+    ASSERT_EQ(mark_row(ctx.model.marks, id), 1);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Marks")
+    RUN_TEST(marks_are_found_by_id);
+    RUN_TEST(marks_follow_edits);
+    RUN_TEST(marks_gravity_at_an_insert);
+    RUN_TEST(marks_match_positions_moved_one_by_one);
+    RUN_TEST(buffer_edits_move_its_marks);
+END_TEST_SUITE()
@@ -0,0 +1,115 @@
+/* test_memstats.c - Unit tests for memory accounting by subsystem
+ *
+ * Tests for:
+ * - The allocation wrappers counting blocks, bytes and the peak
+ * - Arenas counting their chunks under their tag
+ * - Row storage and undo history returning to where they started once
+ *   freed, so every block counted is uncounted
+ */
+
+#include "test_framework.h"
+#include "memstats.h"
+#include "arena.h"
+#include "undo.h"
+#include "loki/core.h"
+#include "internal.h"
+#include <string.h>
+#include <stdlib.h>
+
+static MemTagStats stats_of(MemTag tag) {
+    MemTagStats st;
+    memstats_get(tag, &st);
+    return st;
+}
+
+TEST(tags_have_names) {
+    ASSERT_STR_EQ(memstats_tag_name(MEM_TAG_CORE), "core");
+    ASSERT_STR_EQ(memstats_tag_name(MEM_TAG_TREESITTER), "treesitter");
+    ASSERT_STR_EQ(memstats_tag_name(MEM_TAG_HTTP), "http");
+    ASSERT_NULL(memstats_tag_name(MEM_TAGS));
+}
+
+TEST(wrappers_count_blocks_and_bytes) {
+    memstats_enable();
+    ASSERT_TRUE(memstats_enabled());
+    MemTagStats before = stats_of(MEM_TAG_HTTP);
+
+    char *p = mem_malloc(MEM_TAG_HTTP, 100);
+    ASSERT_NOT_NULL(p);
+    MemTagStats st = stats_of(MEM_TAG_HTTP);
+    ASSERT_TRUE(st.bytes - before.bytes >= 100);
+    ASSERT_EQ(st.allocs, before.allocs + 1);
+
+    p = mem_realloc(MEM_TAG_HTTP, p, 100000);
+    ASSERT_NOT_NULL(p);
+    st = stats_of(MEM_TAG_HTTP);
+    ASSERT_TRUE(st.bytes - before.bytes >= 100000);
+    ASSERT_TRUE(st.peak_bytes >= st.bytes);
+
+    mem_free(MEM_TAG_HTTP, p);
+    st = stats_of(MEM_TAG_HTTP);
+    ASSERT_EQ(st.bytes, before.bytes);
+    ASSERT_TRUE(st.peak_bytes - before.bytes >= 100000);
+    ASSERT_EQ(st.frees, before.frees + 1);
+
+    /* A block from elsewhere, counted once adopted */
+    char *q = malloc(64);
+    mem_adopt(MEM_TAG_HTTP, q);
+    ASSERT_TRUE(stats_of(MEM_TAG_HTTP).bytes - before.bytes >= 64);
+    mem_free(MEM_TAG_HTTP, q);
+    ASSERT_EQ(stats_of(MEM_TAG_HTTP).bytes, before.bytes);
+
+    /* Freeing NULL is not a free */
+    mem_free(MEM_TAG_HTTP, NULL);
+    ASSERT_EQ(stats_of(MEM_TAG_HTTP).frees, before.frees + 2);
+}
+
+TEST(arena_chunks_count_under_its_tag) {
+    memstats_enable();
+    MemTagStats core = stats_of(MEM_TAG_CORE);
+    MemTagStats undo = stats_of(MEM_TAG_UNDO);
+
+    RowArena *arena = arena_create();
+    ASSERT_NOT_NULL(arena);
+    arena_set_tag(arena, MEM_TAG_UNDO);
+    int cap;
+    ASSERT_NOT_NULL(arena_alloc(arena, 17, &cap));
+    ASSERT_NOT_NULL(arena_alloc(arena, 3 * ARENA_MAX_CLASS, &cap));
+    ASSERT_TRUE(stats_of(MEM_TAG_UNDO).bytes - undo.bytes >= 64 * 1024 + 3 * ARENA_MAX_CLASS);
+    ASSERT_EQ(stats_of(MEM_TAG_UNDO).allocs, undo.allocs + 2);
+    ASSERT_EQ(stats_of(MEM_TAG_CORE).bytes, core.bytes);
+
+    arena_destroy(arena);
+    ASSERT_EQ(stats_of(MEM_TAG_UNDO).bytes, undo.bytes);
+}
+
+TEST(rows_and_undo_are_uncounted_when_freed) {
+    memstats_enable();
+    MemTagStats core = stats_of(MEM_TAG_CORE);
+    MemTagStats undo = stats_of(MEM_TAG_UNDO);
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[] = "a line of text that is long enough to matter";
+    for (int i = 0; i < 2000; i++)
+        editor_insert_row(&ctx, ctx.model.numrows, line, strlen(line));
+    for (int i = 0; i < 200; i++) {
+        undo_break_group(&ctx);
+        editor_insert_char(&ctx, 'x');
+    }
+    editor_del_row(&ctx, 10);
+    ASSERT_TRUE(stats_of(MEM_TAG_CORE).bytes - core.bytes >=
+                (int64_t)(2000 * sizeof(t_erow)));
+    ASSERT_TRUE(stats_of(MEM_TAG_UNDO).bytes > undo.bytes);
+
+    editor_ctx_free(&ctx);
+    ASSERT_EQ(stats_of(MEM_TAG_CORE).bytes, core.bytes);
+    ASSERT_EQ(stats_of(MEM_TAG_UNDO).bytes, undo.bytes);
+}
+
+BEGIN_TEST_SUITE("Memory Accounting")
+    RUN_TEST(tags_have_names);
+    RUN_TEST(wrappers_count_blocks_and_bytes);
+    RUN_TEST(arena_chunks_count_under_its_tag);
+    RUN_TEST(rows_and_undo_are_uncounted_when_freed);
+END_TEST_SUITE()
@@ -5,12 +5,19 @@
  * - INSERT mode text entry
  * - VISUAL mode selection
  * - Mode transitions
+ * - Pasted text
+ * - Keys pressed many times in a row
+ * - Counts before motions and operators
+ * - Recorded macros
+ * - Mouse clicks, drags and the wheel
  */
 
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
 #include "selection.h"
+#include "undo.h"
+#include "macro.h"
 #include <string.h>
 
 /* Helper: Create single-line test context */
@@ -23,8 +30,7 @@ static void init_simple_ctx(editor_ctx_t *ctx, const char *text) {
     ctx->model.row[0].size = strlen(text);
     ctx->model.row[0].render = strdup(text);
     ctx->model.row[0].rsize = strlen(text);
-    ctx->model.row[0].hl = NULL;
-    ctx->model.row[0].idx = 0;
+    ctx->model.row[0].hl_buf.hl = NULL;
 
     ctx->view.screenrows = 24;
     ctx->view.screencols = 80;
@@ -42,8 +48,7 @@ static void init_multiline_ctx(editor_ctx_t *ctx, int num_lines, const char **li
         ctx->model.row[i].size = strlen(lines[i]);
         ctx->model.row[i].render = strdup(lines[i]);
         ctx->model.row[i].rsize = strlen(lines[i]);
-        ctx->model.row[i].hl = NULL;
-        ctx->model.row[i].idx = i;
+        ctx->model.row[i].hl_buf.hl = NULL;
     }
 
     ctx->view.screenrows = 24;
@@ -389,6 +394,28 @@ TEST(modal_visual_y_yanks) {
     editor_ctx_free(&ctx);
 }
 
+TEST(modal_visual_d_yanks_and_deletes) {
+    editor_ctx_t ctx;
+    init_simple_ctx(&ctx, "hello world");
+
+    ctx.view.mode = MODE_VISUAL;
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_x = 0;
+    ctx.view.sel_start_y = 0;
+    ctx.view.sel_end_x = 6;
+    ctx.view.sel_end_y = 0;
+
+    modal_process_visual_mode_key(&ctx, 0, 'd');
+
+    /* The yank clears the selection; the delete still has it */
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_FALSE(ctx.view.sel_active);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "world");
+    ASSERT_EQ(ctx.view.cx, 0);
+
+    editor_ctx_free(&ctx);
+}
+
 TEST(modal_visual_selection_highlighting) {
     editor_ctx_t ctx;
     init_simple_ctx(&ctx, "hello world");
@@ -466,6 +493,347 @@ TEST(modal_normal_visual_normal_cycle) {
     editor_ctx_free(&ctx);
 }
 
+/* ============================================================================
+ * Paste Tests
+ * ============================================================================ */
+
+TEST(modal_paste_inserts_text_in_any_mode) {
+    editor_ctx_t ctx;
+    init_simple_ctx(&ctx, "hello");
+
+    ctx.view.cx = 2;
+    ctx.view.mode = MODE_NORMAL;
+
+    /* Keys in it are not commands, and it goes in as it is */
+    EditorEvent ev = event_paste("dd\n  x", 6);
+    modal_process_event(&ctx, &ev);
+
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hedd");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "  xllo");
+    ASSERT_EQ(ctx.view.cy, 1);
+    ASSERT_EQ(ctx.view.cx, 3);
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_TRUE(ctx.model.dirty);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_paste_into_command_line) {
+    editor_ctx_t ctx;
+    init_simple_ctx(&ctx, "hello");
+
+    ctx.view.mode = MODE_NORMAL;
+    modal_process_normal_mode_key(&ctx, 0, ':');
+    ASSERT_EQ(ctx.view.mode, MODE_COMMAND);
+
+    /* Only its first line, never run by its line break */
+    EditorEvent ev = event_paste("set\nq!", 6);
+    modal_process_event(&ctx, &ev);
+
+    ASSERT_EQ(ctx.view.mode, MODE_COMMAND);
+    ASSERT_STR_EQ(ctx.view.cmd_buffer, ":set");
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hello");
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Repeated Key Tests
+ * ============================================================================ */
+
+TEST(modal_repeat_moves_in_one_go) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"one", "two", "three", "four"};
+    init_multiline_ctx(&ctx, 4, lines);
+
+    ctx.view.mode = MODE_NORMAL;
+    EditorEvent ev = event_key('j', MOD_NONE);
+    ev.data.key.repeat = 2;
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.cy, 2);
+
+    /* Held past the end of the file: stops on the line after the last */
+    ev.data.key.repeat = EVENT_REPEAT_MAX;
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.cy, 4);
+
+    ctx.view.cy = 2;
+    ev = event_key(ARROW_RIGHT, MOD_NONE);
+    ev.data.key.repeat = 3;
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.cx, 3);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_repeat_types_every_press) {
+    editor_ctx_t ctx;
+    init_simple_ctx(&ctx, "");
+
+    ctx.view.mode = MODE_INSERT;
+    EditorEvent ev = event_key('l', MOD_NONE);
+    ev.data.key.repeat = 3;
+    modal_process_event(&ctx, &ev);
+
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "lll");
+    ASSERT_EQ(ctx.view.cx, 3);
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Counts
+ * ============================================================================ */
+
+static void type_keys(editor_ctx_t *ctx, const char *keys) {
+    for (const char *k = keys; *k; k++) modal_process_normal_mode_key(ctx, 0, *k);
+}
+
+TEST(modal_count_moves_in_one_go) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"one", "two", "three", "four"};
+    init_multiline_ctx(&ctx, 4, lines);
+
+    type_keys(&ctx, "2j");
+    ASSERT_EQ(ctx.view.cy, 2);
+    type_keys(&ctx, "3l");
+    ASSERT_EQ(ctx.view.cx, 3);
+
+    /* Past the end, as far as the presses would go */
+    type_keys(&ctx, "10000j");
+    ASSERT_EQ(ctx.view.cy, 4);
+    type_keys(&ctx, "3k");
+    ASSERT_EQ(ctx.view.cy, 1);
+    ASSERT_EQ(ctx.view.count, 0);
+
+    /* Left and right carry on over line breaks */
+    ctx.view.cx = 1;
+    type_keys(&ctx, "4h");
+    ASSERT_EQ(ctx.view.cy, 0);
+    ASSERT_EQ(ctx.view.cx, 1);
+    type_keys(&ctx, "5l");
+    ASSERT_EQ(ctx.view.cy, 1);
+    ASSERT_EQ(ctx.view.cx, 2);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_count_dd_is_one_edit) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"a", "b", "c", "d", "e", "f"};
+    init_multiline_ctx(&ctx, 6, lines);
+    undo_init(&ctx, 1000, 10 * 1024 * 1024);
+
+    ctx.view.cy = 1;
+    type_keys(&ctx, "3dd");
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "e");
+    ASSERT_EQ(ctx.view.cy, 1);
+
+    /* One undo brings them all back */
+    type_keys(&ctx, "u");
+    ASSERT_EQ(ctx.model.numrows, 6);
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "d");
+
+    /* Through the last row: the cursor ends on the new last one */
+    ctx.view.cy = 4;
+    type_keys(&ctx, "500dd");
+    ASSERT_EQ(ctx.model.numrows, 4);
+    ASSERT_EQ(ctx.view.cy, 3);
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "d");
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_count_d_motion) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"a", "b", "c", "d", "e", "f"};
+    init_multiline_ctx(&ctx, 6, lines);
+
+    ctx.view.cy = 3;
+    type_keys(&ctx, "dk");
+    ASSERT_EQ(ctx.model.numrows, 4);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "e");
+    ASSERT_EQ(ctx.view.cy, 2);
+
+    /* Counts on both sides of the operator multiply */
+    ctx.view.cy = 0;
+    type_keys(&ctx, "2d1j");
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "f");
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_count_x_deletes_before_cursor) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"ab", "hello"};
+    init_multiline_ctx(&ctx, 2, lines);
+
+    ctx.view.cy = 1;
+    ctx.view.cx = 4;
+    type_keys(&ctx, "3x");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "ho");
+    ASSERT_EQ(ctx.view.cx, 1);
+
+    /* Over the line break, which counts as one */
+    type_keys(&ctx, "3x");
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ao");
+    ASSERT_EQ(ctx.view.cx, 1);
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Macros
+ * ============================================================================ */
+
+static void send_keys(editor_ctx_t *ctx, const char *keys) {
+    for (const char *k = keys; *k; k++) {
+        EditorEvent ev = event_key(*k == '\x1b' ? ESC : *k, MOD_NONE);
+        modal_process_event(ctx, &ev);
+    }
+}
+
+TEST(modal_macro_records_and_plays) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"a", "b", "c", "d", "e", "f", "g"};
+    init_multiline_ctx(&ctx, 7, lines);
+    macro_clear_all();
+
+    /* Delete the line and step over the next */
+    send_keys(&ctx, "qqddjq");
+    ASSERT_EQ(macro_recording(), 0);
+    int n;
+    ASSERT_NOT_NULL(macro_events('q', &n));
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(ctx.model.numrows, 6);
+    ASSERT_EQ(ctx.view.cy, 1);
+
+    send_keys(&ctx, "2@q");
+    ASSERT_EQ(ctx.model.numrows, 4);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "d");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "f");
+    send_keys(&ctx, "@@");
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "f");
+    ASSERT_EQ(macro_playing(), 0);
+
+    macro_clear_all();
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_macro_playback_is_one_undo_step) {
+    editor_ctx_t ctx;
+    init_simple_ctx(&ctx, "");
+    undo_init(&ctx, 1000, 10 * 1024 * 1024);
+    macro_clear_all();
+
+    /* Each i ... ESC would be a group of its own typed by hand */
+    send_keys(&ctx, "qwix\x1bq");
+    send_keys(&ctx, "10@w");
+    ASSERT_EQ(ctx.model.row[0].size, 11);
+
+    send_keys(&ctx, "u");
+    ASSERT_EQ(ctx.model.row[0].size, 1);
+
+    /* Not a register, or nothing in it */
+    send_keys(&ctx, "@z");
+    ASSERT_EQ(ctx.model.row[0].size, 1);
+
+    macro_clear_all();
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Mouse
+ * ============================================================================ */
+
+/* Helper: A context of 'n' lines "line 0", "line 1", ... on 'rows' rows */
+static void init_numbered_ctx(editor_ctx_t *ctx, int n, int rows) {
+    char **lines = malloc((size_t)n * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        lines[i] = malloc(16);
+        snprintf(lines[i], 16, "line %d", i);
+    }
+    init_multiline_ctx(ctx, n, (const char **)lines);
+    ctx->view.screenrows = rows;
+    for (int i = 0; i < n; i++) free(lines[i]);
+    free(lines);
+}
+
+TEST(modal_mouse_wheel_scrolls_the_view) {
+    editor_ctx_t ctx;
+    init_numbered_ctx(&ctx, 40, 10);
+    ctx.view.cx = 5;
+
+    /* Two notches down: the cursor kept on screen, in its column */
+    EditorEvent ev = event_mouse(MOUSE_WHEEL, 0, 1, 1, 2);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.rowoff, 6);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 6);
+    ASSERT_EQ(ctx.view.cx, 5);
+
+    /* No further than the last line at the bottom */
+    ev = event_mouse(MOUSE_WHEEL, 0, 1, 1, 100);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.rowoff, 30);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 30);
+
+    /* Back up, the cursor at the bottom */
+    ev = event_mouse(MOUSE_WHEEL, 0, 1, 1, -3);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.rowoff, 21);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 30);
+    ev = event_mouse(MOUSE_WHEEL, 0, 1, 1, -100);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.rowoff, 0);
+    ASSERT_EQ(ctx.view.cy, 9);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(modal_mouse_drag_selects) {
+    editor_ctx_t ctx;
+    init_numbered_ctx(&ctx, 40, 10);
+
+    /* Click on "line 2", col 3, then drag to "line 4", col 1 */
+    EditorEvent ev = event_mouse(MOUSE_PRESS, 0, 4, 3, 0);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_EQ(ctx.view.cy, 2);
+    ASSERT_EQ(ctx.view.cx, 3);
+    ev = event_mouse(MOUSE_DRAG, 0, 2, 5, 0);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.mode, MODE_VISUAL);
+    ASSERT_EQ(ctx.view.sel_start_y, 2);
+    ASSERT_EQ(ctx.view.sel_start_x, 3);
+    ASSERT_EQ(ctx.view.sel_end_y, 4);
+    ASSERT_EQ(ctx.view.sel_end_x, 1);
+
+    /* Below the text: the view scrolls a line, the selection goes on */
+    ev = event_mouse(MOUSE_DRAG, 0, 1, 12, 0);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.rowoff, 1);
+    ASSERT_EQ(ctx.view.sel_end_y, 10);
+    ASSERT_EQ(ctx.view.sel_start_y, 2);
+    ev = event_mouse(MOUSE_RELEASE, 0, 1, 12, 0);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.mode, MODE_VISUAL);
+
+    /* A click ends it */
+    ev = event_mouse(MOUSE_PRESS, 0, 1, 1, 0);
+    modal_process_event(&ctx, &ev);
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_EQ(ctx.view.sel_active, 0);
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 1);
+
+    editor_ctx_free(&ctx);
+}
+
 BEGIN_TEST_SUITE("Modal Editing")
     /* NORMAL mode navigation */
     RUN_TEST(modal_normal_h_moves_left);
@@ -493,10 +861,31 @@ BEGIN_TEST_SUITE("Modal Editing")
     RUN_TEST(modal_visual_l_extends_right);
     RUN_TEST(modal_visual_esc_returns_normal);
     RUN_TEST(modal_visual_y_yanks);
+    RUN_TEST(modal_visual_d_yanks_and_deletes);
     RUN_TEST(modal_visual_selection_highlighting);
 
     /* Mode transitions */
     RUN_TEST(modal_default_is_normal);
     RUN_TEST(modal_normal_insert_normal_cycle);
     RUN_TEST(modal_normal_visual_normal_cycle);
+
+    /* Paste */
+    RUN_TEST(modal_paste_inserts_text_in_any_mode);
+    RUN_TEST(modal_paste_into_command_line);
+
+    /* Repeated keys */
+    RUN_TEST(modal_repeat_moves_in_one_go);
+    RUN_TEST(modal_repeat_types_every_press);
+
+    /* Counts */
+    RUN_TEST(modal_count_moves_in_one_go);
+    RUN_TEST(modal_count_dd_is_one_edit);
+    RUN_TEST(modal_count_d_motion);
+    RUN_TEST(modal_count_x_deletes_before_cursor);
+
+    /* Macros */
+    RUN_TEST(modal_macro_records_and_plays);
+    RUN_TEST(modal_macro_playback_is_one_undo_step);
+    RUN_TEST(modal_mouse_wheel_scrolls_the_view);
+    RUN_TEST(modal_mouse_drag_selects);
 END_TEST_SUITE()
@@ -0,0 +1,132 @@
+/* test_model_snapshot.c - Unit tests for buffer snapshots
+ *
+ * Tests for:
+ * - A snapshot keeping the text it was taken with while the buffer is
+ *   edited, and sharing it rather than copying
+ * - The same snapshot again for a buffer unchanged since
+ * - Reading and letting go of a snapshot on another thread while the
+ *   buffer is edited, and outliving the buffer
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "model_snapshot.h"
+#include <uv.h>
+#include <stdlib.h>
+#include <string.h>
+
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
+
+static void insert_lines(editor_ctx_t *ctx, const char **lines, int n) {
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, ctx->model.numrows, (char *)lines[i], strlen(lines[i]));
+}
+
+TEST(snapshot_keeps_text_while_edited) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"one", "two", "three"};
+    insert_lines(&ctx, lines, 3);
+
+    EditorSnapshot *snap = editor_model_snapshot(&ctx);
+    ASSERT_EQ(editor_snapshot_numrows(snap), 3);
+    size_t len;
+    const char *row = editor_snapshot_row(snap, 1, &len);
+    ASSERT_EQ(len, 3);
+    ASSERT_STR_EQ(row, "two");
+    ASSERT_TRUE(row == ctx.model.row[1].chars);     /* Shared, not copied */
+
+    editor_row_set(&ctx, &ctx.model.row[1], "TWO!", 4);
+    editor_row_insert_char(&ctx, &ctx.model.row[0], 0, 'x');
+    editor_del_row(&ctx, 2);
+    editor_insert_row(&ctx, 0, "zero", 4);
+
+    char *text = editor_snapshot_text(snap, &len);
+    ASSERT_STR_EQ(text, "one\ntwo\nthree\n");
+    ASSERT_EQ(len, strlen("one\ntwo\nthree\n"));
+    free(text);
+    ASSERT_NULL(editor_snapshot_row(snap, 3, &len));
+    ASSERT_EQ(len, 0);
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "TWO!");
+
+    editor_snapshot_release(snap);
+    editor_ctx_free(&ctx);
+}
+
+TEST(snapshot_reused_until_changed) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"a", "b"};
+    insert_lines(&ctx, lines, 2);
+
+    EditorSnapshot *first = editor_model_snapshot(&ctx);
+    EditorSnapshot *again = editor_model_snapshot(&ctx);
+    ASSERT_TRUE(first == again);
+    editor_snapshot_release(again);
+
+    editor_row_append_string(&ctx, &ctx.model.row[1], "c", 1);
+    EditorSnapshot *newer = editor_model_snapshot(&ctx);
+    ASSERT_TRUE(newer != first);
+    ASSERT_STR_EQ(editor_snapshot_row(newer, 1, NULL), "bc");
+    ASSERT_STR_EQ(editor_snapshot_row(first, 1, NULL), "b");
+    /* The row not edited is shared by both */
+    ASSERT_TRUE(editor_snapshot_row(newer, 0, NULL) == editor_snapshot_row(first, 0, NULL));
+
+    /* Once let go of, it is not handed out again */
+    editor_snapshot_release(first);
+    editor_snapshot_release(newer);
+    EditorSnapshot *fresh = editor_model_snapshot(&ctx);
+    ASSERT_EQ(editor_snapshot_numrows(fresh), 2);
+    editor_snapshot_release(fresh);
+
+    editor_ctx_free(&ctx);
+}
+
+static size_t thread_total;
+
+/* Read the whole snapshot many times over, then let go of it here */
+static void read_on_thread(void *arg) {
+    EditorSnapshot *snap = arg;
+    size_t total = 0;
+    for (int pass = 0; pass < 200; pass++) {
+        for (int i = 0; i < editor_snapshot_numrows(snap); i++) {
+            size_t len;
+            const char *row = editor_snapshot_row(snap, i, &len);
+            total += strlen(row) == len ? len : 0;
+        }
+    }
+    thread_total = total;
+    editor_snapshot_release(snap);
+}
+
+TEST(snapshot_read_and_released_on_thread) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"alpha", "beta", "gamma", "delta"};
+    for (int i = 0; i < 50; i++) insert_lines(&ctx, lines, 4);
+
+    EditorSnapshot *snap = editor_model_snapshot(&ctx);
+    uv_thread_t thread;
+    ASSERT_EQ(uv_thread_create(&thread, read_on_thread, snap), 0);
+    for (int i = 0; i < 180; i++) {
+        editor_row_set(&ctx, &ctx.model.row[i], "edited", 6);
+        if (i % 9 == 0) editor_del_row(&ctx, ctx.model.numrows - 1);
+    }
+    uv_thread_join(&thread);
+    ASSERT_EQ(thread_total, 200u * 50u * (5 + 4 + 5 + 5));
+
+    /* A snapshot outlives its buffer */
+    snap = editor_model_snapshot(&ctx);
+    editor_ctx_free(&ctx);
+    ASSERT_STR_EQ(editor_snapshot_row(snap, 0, NULL), "edited");
+    ASSERT_EQ(editor_snapshot_numrows(snap), 180);
+    editor_snapshot_release(snap);
+    editor_snapshot_reap();
+}
+
+BEGIN_TEST_SUITE("Model Snapshots")
+    RUN_TEST(snapshot_keeps_text_while_edited);
+    RUN_TEST(snapshot_reused_until_changed);
+    RUN_TEST(snapshot_read_and_released_on_thread);
+END_TEST_SUITE()
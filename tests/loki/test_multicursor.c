@@ -0,0 +1,239 @@
+/* test_multicursor.c - Unit tests for block selections and multiple cursors
+ *
+ * Tests for:
+ * - Ctrl-V block selections: is_selected(), their text, their deletion
+ * - Visual block I/A putting a cursor on every row
+ * - Typing, backspace and left/right at every cursor, undone as one edit
+ * - Cursors that meet merging into one
+ * - A single-line paste at every cursor
+ * - Thousands of cursors
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "selection.h"
+#include "multicursor.h"
+#include "undo.h"
+#include "event.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Helper: Create multi-line test context */
+static void init_multiline_ctx(editor_ctx_t *ctx, int num_lines, const char **lines) {
+    editor_ctx_init(ctx);
+
+    ctx->model.numrows = num_lines;
+    ctx->model.row = calloc(num_lines, sizeof(t_erow));
+
+    for (int i = 0; i < num_lines; i++) {
+        ctx->model.row[i].chars = strdup(lines[i]);
+        ctx->model.row[i].size = strlen(lines[i]);
+        ctx->model.row[i].render = strdup(lines[i]);
+        ctx->model.row[i].rsize = strlen(lines[i]);
+        ctx->model.row[i].hl_buf.hl = NULL;
+    }
+
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+}
+
+/* Helper: Select the block of columns x0..x1 (inclusive) on rows y0..y1 */
+static void select_block(editor_ctx_t *ctx, int y0, int x0, int y1, int x1) {
+    ctx->view.mode = MODE_VISUAL;
+    ctx->view.sel_active = 1;
+    ctx->view.sel_block = 1;
+    ctx->view.sel_start_y = y0;
+    ctx->view.sel_start_x = x0;
+    ctx->view.sel_end_y = y1;
+    ctx->view.sel_end_x = x1;
+}
+
+static void type(editor_ctx_t *ctx, const char *keys) {
+    for (const char *p = keys; *p; p++) modal_process_insert_mode_key(ctx, 0, *p);
+}
+
+static const char *block_lines[] = {"abcdef", "ghijkl", "mn", "opqrst"};
+
+/* ============================================================================
+ * Block selections
+ * ============================================================================ */
+
+TEST(multicursor_ctrl_v_starts_block_selection) {
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 4, block_lines);
+    ctx.view.cx = 1;
+
+    modal_process_normal_mode_key(&ctx, 0, CTRL_V);
+    ASSERT_EQ(ctx.view.mode, MODE_VISUAL);
+    ASSERT_TRUE(ctx.view.sel_active);
+    ASSERT_TRUE(ctx.view.sel_block);
+
+    modal_process_visual_mode_key(&ctx, 0, 'j');
+    modal_process_visual_mode_key(&ctx, 0, 'l');
+    ASSERT_TRUE(is_selected(&ctx, 0, 2));
+    ASSERT_FALSE(is_selected(&ctx, 0, 3));      /* Not to the end of the row */
+    ASSERT_TRUE(is_selected(&ctx, 1, 1));
+
+    modal_process_visual_mode_key(&ctx, 0, ESC);
+    ASSERT_EQ(ctx.view.mode, MODE_NORMAL);
+    ASSERT_FALSE(ctx.view.sel_block);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(multicursor_block_text_and_delete) {
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 4, block_lines);
+    select_block(&ctx, 3, 3, 0, 1);             /* Selected backwards */
+
+    char *text = get_selection_text(&ctx);
+    ASSERT_NOT_NULL(text);
+    ASSERT_STR_EQ(text, "bcd\nhij\nn\npqr");
+    free(text);
+
+    ASSERT_EQ(delete_selection(&ctx), 10);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "aef");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "gkl");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "m");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "ost");
+    ASSERT_EQ(ctx.view.cy, 0);
+    ASSERT_EQ(ctx.view.cx, 1);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, block_lines[i]);
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Cursors from a block
+ * ============================================================================ */
+
+TEST(multicursor_block_I_types_on_every_row) {
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 4, block_lines);
+    select_block(&ctx, 0, 3, 3, 4);
+
+    modal_process_visual_mode_key(&ctx, 0, 'I');
+    ASSERT_EQ(ctx.view.mode, MODE_INSERT);
+    ASSERT_FALSE(ctx.view.sel_active);
+    ASSERT_EQ(multicursor_count(&ctx), 2);      /* "mn" is too short */
+    ASSERT_EQ(ctx.view.cy, 0);
+    ASSERT_EQ(ctx.view.cx, 3);
+
+    type(&ctx, "XY");
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abcXYdef");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "ghiXYjkl");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "mn");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "opqXYrst");
+    ASSERT_EQ(ctx.view.cx, 5);
+
+    modal_process_insert_mode_key(&ctx, 0, BACKSPACE);
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "opqXrst");
+
+    /* One undo per keystroke, whatever the cursors */
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "ghiXYjkl");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, block_lines[i]);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(multicursor_block_A_appends_and_clamps) {
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 4, block_lines);
+    select_block(&ctx, 1, 2, 3, 3);
+
+    modal_process_visual_mode_key(&ctx, 0, 'A');
+    ASSERT_EQ(multicursor_count(&ctx), 2);
+    type(&ctx, "|");
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abcdef");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "ghij|kl");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "mn|");     /* At the end of a short row */
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "opqr|st");
+
+    /* ESC keeps only the view's own cursor */
+    modal_process_insert_mode_key(&ctx, 0, ESC);
+    ASSERT_EQ(multicursor_count(&ctx), 0);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(multicursor_moves_and_merges) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"abc"};
+    init_multiline_ctx(&ctx, 1, lines);
+    ctx.view.mode = MODE_INSERT;
+    ctx.view.cx = 1;
+    multicursor_add(&ctx, 0, 2);
+    multicursor_add(&ctx, 0, 2);                /* Already there */
+    multicursor_add(&ctx, 0, 1);                /* The view's own */
+    ASSERT_EQ(multicursor_count(&ctx), 1);
+
+    int col;
+    ASSERT_TRUE(multicursor_on_row(&ctx, 0, &col));
+    ASSERT_EQ(col, 2);
+
+    type(&ctx, "-");
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "a-b-c");
+    ASSERT_EQ(ctx.view.cx, 2);
+
+    /* Backspace at both, then left past the start of the row: they meet */
+    modal_process_insert_mode_key(&ctx, 0, BACKSPACE);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "abc");
+    for (int i = 0; i < 3; i++) modal_process_insert_mode_key(&ctx, 0, ARROW_LEFT);
+    ASSERT_EQ(multicursor_count(&ctx), 0);
+    ASSERT_EQ(ctx.view.cx, 0);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(multicursor_paste_goes_to_every_cursor) {
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 4, block_lines);
+    select_block(&ctx, 0, 0, 1, 0);
+    modal_process_visual_mode_key(&ctx, 0, 'I');
+
+    EditorEvent paste = event_paste("> ", 2);
+    modal_process_event(&ctx, &paste);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "> abcdef");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "> ghijkl");
+    ASSERT_EQ(multicursor_count(&ctx), 1);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(multicursor_many_cursors) {
+    enum { N = 10000 };
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+    for (int i = 0; i < N; i++) editor_insert_row(&ctx, i, (char *)"value", 5);
+    select_block(&ctx, N - 1, 0, 0, 0);
+
+    modal_process_visual_mode_key(&ctx, 0, 'I');
+    ASSERT_EQ(multicursor_count(&ctx), N - 1);
+    ASSERT_EQ(multicursor_insert(&ctx, "x = ", 4), N);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "x = value");
+    ASSERT_STR_EQ(ctx.model.row[N - 1].chars, "x = value");
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[N / 2].chars, "value");
+
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Multiple Cursors")
+    RUN_TEST(multicursor_ctrl_v_starts_block_selection);
+    RUN_TEST(multicursor_block_text_and_delete);
+    RUN_TEST(multicursor_block_I_types_on_every_row);
+    RUN_TEST(multicursor_block_A_appends_and_clamps);
+    RUN_TEST(multicursor_moves_and_merges);
+    RUN_TEST(multicursor_paste_goes_to_every_cursor);
+    RUN_TEST(multicursor_many_cursors);
+END_TEST_SUITE()
@@ -0,0 +1,98 @@
+/* test_perfhud.c - Unit tests for the performance HUD
+ *
+ * Tests for:
+ * - Spans and frames sampled only while the HUD is on
+ * - The percentiles over the frames kept
+ * - The HUD drawn over the end of the message line
+ */
+
+#include "test_framework.h"
+#include "perfhud.h"
+#include "trace.h"
+#include <string.h>
+
+TEST(nothing_is_sampled_while_off) {
+    perfhud_set(0);
+    ASSERT_EQ(trace_begin(), 0);        /* No trace, no HUD: not timed */
+    perfhud_span("rows", 1000);
+    perfhud_frame(100, 5);
+    ASSERT_EQ(perfhud_frames(), 0);
+
+    char buf[64];
+    ASSERT_STR_EQ(perfhud_message_line("saved", 40, buf, sizeof(buf)), "saved");
+    ASSERT_NULL(perfhud_message_line(NULL, 40, buf, sizeof(buf)));
+}
+
+TEST(frames_take_the_spans_since_the_last) {
+    perfhud_set(1);
+    ASSERT_TRUE(trace_begin() != 0);    /* Timed for the HUD */
+    perfhud_span("rows", 3000000);
+    perfhud_span("syntax", 500000);
+    perfhud_span("syntax", 500000);
+    perfhud_span("flush", 9000000);     /* Not a figure of its own */
+    perfhud_frame(2048, 7);
+    perfhud_frame(0, 0);
+    ASSERT_EQ(perfhud_frames(), 2);
+
+    PerfHudStat st;
+    perfhud_get(PERFHUD_SYNTAX_NS, &st);
+    ASSERT_EQ(st.last, 0);              /* The second frame had none */
+    ASSERT_EQ(st.p99, 1000000);
+    perfhud_get(PERFHUD_BYTES, &st);
+    ASSERT_EQ(st.p99, 2048);
+    perfhud_get(PERFHUD_ROWS, &st);
+    ASSERT_EQ(st.p50, 0);
+    ASSERT_EQ(st.p99, 7);
+    perfhud_set(0);
+}
+
+TEST(percentiles_cover_the_last_frames_only) {
+    perfhud_set(1);
+    for (int i = 1; i <= PERFHUD_FRAMES; i++) perfhud_frame(1000000, i);
+    PerfHudStat st;
+    perfhud_get(PERFHUD_ROWS, &st);
+    ASSERT_EQ(st.last, PERFHUD_FRAMES);
+    ASSERT_EQ(st.p50, PERFHUD_FRAMES / 2);
+    ASSERT_EQ(st.p99, (PERFHUD_FRAMES * 99 + 99) / 100);
+
+    /* Older frames roll out */
+    for (int i = 0; i < PERFHUD_FRAMES; i++) perfhud_frame(0, 1);
+    ASSERT_EQ(perfhud_frames(), PERFHUD_FRAMES);
+    perfhud_get(PERFHUD_ROWS, &st);
+    ASSERT_EQ(st.p99, 1);
+
+    /* Turned on again, it starts over */
+    perfhud_set(0);
+    perfhud_set(1);
+    ASSERT_EQ(perfhud_frames(), 0);
+    perfhud_set(0);
+}
+
+TEST(hud_goes_over_the_end_of_the_message_line) {
+    perfhud_set(1);
+    perfhud_span("rows", 1500000);
+    perfhud_frame(20000, 3);
+
+    char hud[256];
+    int len = perfhud_format(hud, sizeof(hud));
+    ASSERT_EQ(len, (int)strlen(hud));
+    ASSERT_TRUE(strncmp(hud, "build 1.50/1.50ms out 19.5k/19.5k rows 3/3", 42) == 0);
+
+    char buf[256];
+    const char *line = perfhud_message_line("written", 200, buf, sizeof(buf));
+    ASSERT_EQ((int)strlen(line), 200);
+    ASSERT_TRUE(strncmp(line, "written ", 8) == 0);
+    ASSERT_STR_EQ(line + 200 - len, hud);
+
+    /* Narrower than the HUD: the HUD, cut */
+    line = perfhud_message_line("written", 10, buf, sizeof(buf));
+    ASSERT_STR_EQ(line, "build 1.50");
+    perfhud_set(0);
+}
+
+BEGIN_TEST_SUITE("Performance HUD")
+    RUN_TEST(nothing_is_sampled_while_off);
+    RUN_TEST(frames_take_the_spans_since_the_last);
+    RUN_TEST(percentiles_cover_the_last_frames_only);
+    RUN_TEST(hud_goes_over_the_end_of_the_message_line);
+END_TEST_SUITE()
@@ -0,0 +1,174 @@
+/* test_preview.c - Unit tests for the live Markdown preview
+ *
+ * Tests for:
+ * - The page, the rendering and unknown paths over HTTP
+ * - Renders published once edits pause, and followers of /events told
+ * - Moving the preview to another buffer, stopping it, and freeing the
+ *   buffer previewed
+ *
+ * The clients are plain blocking sockets; the server runs on its own
+ * thread, and the editor's side is ticked here as the main loop would.
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "preview.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static void insert_lines(editor_ctx_t *ctx, const char **lines, int n) {
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, ctx->model.numrows, (char *)lines[i], strlen(lines[i]));
+}
+
+/* Helper: Tick the preview until it has nothing left to do */
+static void settle(void) {
+    int due;
+    for (int tries = 0; tries < 500 && (due = preview_tick(uv_hrtime())) >= 0; tries++)
+        usleep((useconds_t)due * 1000);
+}
+
+static int connect_port(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Helper: Read from 'fd' until 'want' comes, or it closes, or time is up.
+ * Returns what was read (in a static buffer). */
+static const char *recv_until(int fd, const char *want) {
+    static char buf[65536];
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int tries = 0; tries < 200 && len < sizeof(buf) - 1; tries++) {
+        if (want && strstr(buf, want)) break;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0) break;
+        len += (size_t)n;
+        buf[len] = '\0';
+    }
+    return buf;
+}
+
+/* Helper: GET 'path', returning the whole response */
+static const char *get(int port, const char *path) {
+    int fd = connect_port(port);
+    if (fd < 0) return "";
+    char req[256];
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    const char *resp = write(fd, req, (size_t)n) == n ? recv_until(fd, NULL) : "";
+    close(fd);
+    return resp;
+}
+
+TEST(preview_serves_page_and_content) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"# Title", "", "Some *text*."};
+    insert_lines(&ctx, lines, 3);
+
+    char err[256];
+    int port = preview_start(&ctx, 0, err, sizeof(err));
+    ASSERT_TRUE(port > 0);
+    ASSERT_EQ(preview_port(), port);
+    settle();
+
+    const char *resp = get(port, "/content");
+    ASSERT_NOT_NULL(strstr(resp, "HTTP/1.1 200 OK"));
+    ASSERT_NOT_NULL(strstr(resp, "<h1>Title</h1>\n<p>Some <em>text</em>.</p>"));
+
+    resp = get(port, "/");
+    ASSERT_NOT_NULL(strstr(resp, "EventSource('/events')"));
+    resp = get(port, "/nothing");
+    ASSERT_NOT_NULL(strstr(resp, "404 Not Found"));
+
+    preview_stop();
+    ASSERT_EQ(preview_port(), -1);
+    ASSERT_TRUE(connect_port(port) < 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(preview_pushes_edits_to_followers) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *lines[] = {"# One"};
+    insert_lines(&ctx, lines, 1);
+
+    char err[256];
+    int port = preview_start(&ctx, 0, err, sizeof(err));
+    ASSERT_TRUE(port > 0);
+    settle();
+
+    int fd = connect_port(port);
+    ASSERT_TRUE(fd >= 0);
+    const char *req = "GET /events HTTP/1.1\r\n\r\n";
+    ASSERT_TRUE(write(fd, req, strlen(req)) == (ssize_t)strlen(req));
+    const char *got = recv_until(fd, "data: 1\n\n");
+    ASSERT_NOT_NULL(strstr(got, "text/event-stream"));
+    ASSERT_NOT_NULL(strstr(got, "data: 1\n\n"));
+
+    /* Edits wait for a pause, then make one new version */
+    editor_row_set(&ctx, &ctx.model.row[0], "# Two", 5);
+    ASSERT_TRUE(preview_tick(uv_hrtime()) > 0);
+    editor_insert_row(&ctx, 1, "text", 4);
+    settle();
+    got = recv_until(fd, "data: 2\n\n");
+    ASSERT_NOT_NULL(strstr(got, "data: 2\n\n"));
+    ASSERT_NOT_NULL(strstr(get(port, "/content"), "<h1>Two</h1>\n<p>text</p>"));
+
+    /* An edit that renders the same is not pushed */
+    editor_row_set(&ctx, &ctx.model.row[1], "text", 4);
+    settle();
+    ASSERT_NULL(strstr(recv_until(fd, "data: 3"), "data: 3"));
+
+    close(fd);
+    preview_stop();
+    editor_ctx_free(&ctx);
+}
+
+TEST(preview_moves_and_detaches) {
+    editor_ctx_t a, b;
+    editor_ctx_init(&a);
+    editor_ctx_init(&b);
+    const char *la[] = {"# A"}, *lb[] = {"# B"};
+    insert_lines(&a, la, 1);
+    insert_lines(&b, lb, 1);
+
+    char err[256];
+    int port = preview_start(&a, 0, err, sizeof(err));
+    ASSERT_TRUE(port > 0);
+    ASSERT_EQ(preview_start(&b, 0, err, sizeof(err)), port);
+    settle();
+    ASSERT_NOT_NULL(strstr(get(port, "/content"), "<h1>B</h1>"));
+
+    /* Freeing another buffer leaves it; freeing this one stops it */
+    editor_ctx_free(&a);
+    ASSERT_EQ(preview_port(), port);
+    editor_insert_row(&b, 1, "more", 4);
+    preview_tick(uv_hrtime());
+    editor_ctx_free(&b);
+    ASSERT_EQ(preview_port(), -1);
+}
+
+BEGIN_TEST_SUITE("Preview")
+    RUN_TEST(preview_serves_page_and_content);
+    RUN_TEST(preview_pushes_edits_to_followers);
+    RUN_TEST(preview_moves_and_detaches);
+END_TEST_SUITE()
@@ -0,0 +1,254 @@
+/* test_recovery.c - Unit tests for unsaved changes kept against a crash
+ *
+ * Tests for:
+ * - Edits, undone groups and the open group coming back after a crash
+ * - Nothing left behind by a save, or to replay over a changed file
+ * - Journals cut short, and journals discarded
+ *
+ * A crash is a child process that edits and exits without cleaning up.
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "undo.h"
+#include "undo_journal.h"
+#include "recovery.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_DIR "/tmp/loki_recovery_test"
+#define TEST_FILE TEST_DIR "/doc.txt"
+#define TEST_JOURNALS TEST_DIR "/recover"
+
+static void write_doc(const char *content) {
+    FILE *f = fopen(TEST_FILE, "w");
+    if (f) {
+        fputs(content, f);
+        fclose(f);
+    }
+}
+
+static void setup(const char *content) {
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    undo_journal_set_dir("");
+    recovery_set_dir(TEST_JOURNALS);
+    write_doc(content);
+}
+
+static void teardown(void) {
+    recovery_set_dir(NULL);
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+static void open_doc(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    editor_open(ctx, TEST_FILE);
+}
+
+/* A tick due whenever it is called */
+static void tick(void) {
+    static uint64_t now = 0;
+    now += 10ull * 1000000000ull;
+    recovery_tick(now);
+}
+
+/* Path of the one journal in TEST_JOURNALS ("" if there is none) */
+static void journal_path(char *path, size_t size) {
+    path[0] = '\0';
+    DIR *d = opendir(TEST_JOURNALS);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (strstr(e->d_name, ".rec"))
+            snprintf(path, size, "%s/%s", TEST_JOURNALS, e->d_name);
+    closedir(d);
+}
+
+/* Type 'c' at the end of the first row, in the open group */
+static void type_char(editor_ctx_t *ctx, char c) {
+    ctx->view.cy = ctx->view.rowoff = 0;
+    ctx->view.cx = ctx->model.row[0].size;
+    ctx->view.coloff = 0;
+    editor_insert_char(ctx, c);
+}
+
+static void type_group(editor_ctx_t *ctx, char c) {
+    undo_break_group(ctx);
+    type_char(ctx, c);
+    undo_break_group(ctx);
+}
+
+/* Run 'edit' on the document in a child that then dies */
+static void crash_after(void (*edit)(editor_ctx_t *ctx)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        editor_ctx_t ctx;
+        open_doc(&ctx);
+        edit(&ctx);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+/* ============================================================================
+ * Recovering
+ * ============================================================================ */
+
+static void edit_groups(editor_ctx_t *ctx) {
+    type_group(ctx, 'a');
+    type_group(ctx, 'b');
+    type_group(ctx, 'x');
+    undo_perform(ctx);              /* x */
+    ctx->view.cy = 1;
+    ctx->view.cx = 1;
+    editor_insert_newline(ctx);
+    undo_break_group(ctx);
+    type_char(ctx, 'c');            /* Open: written by the tick */
+    type_char(ctx, 'd');
+    tick();
+}
+
+TEST(recovery_restores_edits_after_a_crash) {
+    setup("one\ntwo\n");
+    crash_after(edit_groups);
+
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    ASSERT_TRUE(recovery_found(&ctx));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "one");
+    ASSERT_FALSE(ctx.model.dirty);
+
+    char err[128];
+    ASSERT_TRUE(recovery_replay(&ctx, err, sizeof(err)) > 0);
+    ASSERT_FALSE(recovery_found(&ctx));
+    ASSERT_TRUE(ctx.model.dirty);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneabcd");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "t");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "wo");
+
+    /* The history starts from the recovered text */
+    ASSERT_FALSE(undo_can_undo(&ctx));
+    type_group(&ctx, 'e');
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneabcd");
+
+    /* Saving removes the journal */
+    char path[512];
+    journal_path(path, sizeof(path));
+    ASSERT_TRUE(path[0] != '\0');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    journal_path(path, sizeof(path));
+    ASSERT_STR_EQ(path, "");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+static void edit_and_save(editor_ctx_t *ctx) {
+    type_group(ctx, 'a');
+    tick();
+    editor_save(ctx);
+}
+
+TEST(recovery_leaves_nothing_behind_a_save) {
+    setup("one\n");
+    crash_after(edit_and_save);
+
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    ASSERT_FALSE(recovery_found(&ctx));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "onea");
+    char path[512];
+    journal_path(path, sizeof(path));
+    ASSERT_STR_EQ(path, "");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+static void edit_one(editor_ctx_t *ctx) {
+    type_group(ctx, 'a');
+    tick();
+}
+
+TEST(recovery_refuses_a_file_changed_since) {
+    setup("one\n");
+    crash_after(edit_one);
+    write_doc("other text\n");
+
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    ASSERT_TRUE(recovery_found(&ctx));
+    char err[128];
+    ASSERT_EQ(recovery_replay(&ctx, err, sizeof(err)), -1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "other text");
+    ASSERT_FALSE(ctx.model.dirty);
+
+    /* Discarded, it is gone and edits are journaled again */
+    recovery_discard(&ctx);
+    ASSERT_FALSE(recovery_found(&ctx));
+    char path[512];
+    journal_path(path, sizeof(path));
+    ASSERT_STR_EQ(path, "");
+    type_group(&ctx, 'b');
+    journal_path(path, sizeof(path));
+    ASSERT_TRUE(path[0] != '\0');
+    editor_ctx_free(&ctx);
+    journal_path(path, sizeof(path));
+    ASSERT_STR_EQ(path, "");
+    teardown();
+}
+
+/* ============================================================================
+ * Damaged journals
+ * ============================================================================ */
+
+static void edit_three(editor_ctx_t *ctx) {
+    type_group(ctx, 'a');
+    type_group(ctx, 'b');
+    type_group(ctx, 'c');
+    tick();
+}
+
+TEST(recovery_stops_at_a_record_cut_short) {
+    setup("one\n");
+    crash_after(edit_three);
+
+    /* The crash tore the last record */
+    char path[512];
+    journal_path(path, sizeof(path));
+    struct stat st;
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ(truncate(path, st.st_size - 1), 0);
+
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    char err[128];
+    ASSERT_EQ(recovery_replay(&ctx, err, sizeof(err)), 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneab");
+
+    /* Carried on from the last good record */
+    type_group(&ctx, 'z');
+    ASSERT_TRUE(stat(path, &st) == 0);
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+BEGIN_TEST_SUITE("Recovery")
+    /* Recovering */
+    RUN_TEST(recovery_restores_edits_after_a_crash);
+    RUN_TEST(recovery_leaves_nothing_behind_a_save);
+    RUN_TEST(recovery_refuses_a_file_changed_since);
+
+    /* Damaged journals */
+    RUN_TEST(recovery_stops_at_a_record_cut_short);
+END_TEST_SUITE()
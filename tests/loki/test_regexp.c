@@ -0,0 +1,181 @@
+/* test_regexp.c - Unit tests for regular expressions
+ *
+ * Tests for:
+ * - Byte classes, escapes, repetition and alternation
+ * - Leftmost match, and Perl's choice among those starting there
+ * - Anchors, lazy repetition and ignoring case
+ * - Linear time on patterns that make backtracking exponential
+ * - Compile errors
+ */
+
+#include "test_framework.h"
+#include "regexp.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Match of 'pattern' in 'text' searching from 'from' as "start,end", or
+ * "none"; "error" if it does not compile */
+static const char *match(const char *pattern, int flags, const char *text,
+                         int from) {
+    static char buf[32];
+    const char *error;
+    Regexp *re = regexp_compile(pattern, flags, &error);
+    if (!re) return "error";
+
+    int start, end;
+    if (regexp_search(re, text, (int)strlen(text), from, &start, &end))
+        snprintf(buf, sizeof(buf), "%d,%d", start, end);
+    else
+        snprintf(buf, sizeof(buf), "none");
+    regexp_free(re);
+    return buf;
+}
+
+/* ======================= Syntax ============================================ */
+
+TEST(regexp_matches_literals_and_classes) {
+    ASSERT_STR_EQ(match("abc", 0, "xxabcxx", 0), "2,5");
+    ASSERT_STR_EQ(match("a.c", 0, "abd a-c", 0), "4,7");
+    ASSERT_STR_EQ(match("[a-c]+", 0, "zzbcaz", 0), "2,5");
+    ASSERT_STR_EQ(match("[^a-z]", 0, "abC", 0), "2,3");
+    ASSERT_STR_EQ(match("[]x]", 0, "a]", 0), "1,2");
+    ASSERT_STR_EQ(match("[\\d.]+", 0, "v1.25x", 0), "1,5");
+    ASSERT_STR_EQ(match("\\w+@\\w+\\.com", 0, "mail bob@ex.com now", 0), "5,15");
+    ASSERT_STR_EQ(match("\\s\\S", 0, "ab\tc", 0), "2,4");
+    ASSERT_STR_EQ(match("\\D", 0, "12a", 0), "2,3");
+    ASSERT_STR_EQ(match("a\\.b", 0, "axb a.b", 0), "4,7");
+    ASSERT_STR_EQ(match("\\t", 0, "a\tb", 0), "1,2");
+}
+
+TEST(regexp_repeats_and_alternates) {
+    ASSERT_STR_EQ(match("a+", 0, "baaab", 0), "1,4");
+    ASSERT_STR_EQ(match("ba*c", 0, "bc", 0), "0,2");
+    ASSERT_STR_EQ(match("colou?r", 0, "color", 0), "0,5");
+    ASSERT_STR_EQ(match("\\d{2,3}", 0, "a12345", 0), "1,4");
+    ASSERT_STR_EQ(match("a{3}", 0, "aaaa", 0), "0,3");
+    ASSERT_STR_EQ(match("a{2,}", 0, "a aaaaa", 0), "2,7");
+    ASSERT_STR_EQ(match("(ab)*c", 0, "xababc", 0), "1,6");
+    ASSERT_STR_EQ(match("(?:x|y)z", 0, "ayz", 0), "1,3");
+    ASSERT_STR_EQ(match("cat|dog", 0, "hotdog", 0), "3,6");
+}
+
+/* ======================= Which Match ======================================= */
+
+TEST(regexp_prefers_leftmost_then_first_alternative) {
+    /* Leftmost wins over an alternative matching earlier in the list */
+    ASSERT_STR_EQ(match("abcd|c", 0, "xabcd", 0), "1,5");
+    /* Among matches at one start, the first alternative */
+    ASSERT_STR_EQ(match("a|ab", 0, "ab", 0), "0,1");
+    ASSERT_STR_EQ(match("ab|a", 0, "ab", 0), "0,2");
+    /* An empty match counts */
+    ASSERT_STR_EQ(match("x*", 0, "abc", 0), "0,0");
+}
+
+TEST(regexp_lazy_repeats_take_the_shortest) {
+    ASSERT_STR_EQ(match("b.*d", 0, "abcdd", 0), "1,5");
+    ASSERT_STR_EQ(match("b.*?d", 0, "abcdd", 0), "1,4");
+    ASSERT_STR_EQ(match("a+?", 0, "baaab", 0), "1,2");
+    ASSERT_STR_EQ(match("a{2,4}?", 0, "aaaa", 0), "0,2");
+    ASSERT_STR_EQ(match("<.+?>", 0, "<a><b>", 0), "0,3");
+}
+
+TEST(regexp_anchors_match_row_ends) {
+    ASSERT_STR_EQ(match("^a", 0, "ba", 0), "none");
+    ASSERT_STR_EQ(match("^b", 0, "ba", 0), "0,1");
+    ASSERT_STR_EQ(match("a$", 0, "aba", 0), "2,3");
+    ASSERT_STR_EQ(match("^$", 0, "", 0), "0,0");
+    ASSERT_STR_EQ(match("$", 0, "abc", 0), "3,3");
+    ASSERT_STR_EQ(match("^abc$", 0, "abcd", 0), "none");
+    ASSERT_STR_EQ(match("x$|b", 0, "abx", 0), "1,2");
+    /* ^ is the start of the text, not of the search */
+    ASSERT_STR_EQ(match("^a", 0, "aa", 1), "none");
+}
+
+TEST(regexp_searches_from_offset) {
+    ASSERT_STR_EQ(match("ab", 0, "abab", 1), "2,4");
+    ASSERT_STR_EQ(match("ab", 0, "abab", 3), "none");
+    ASSERT_STR_EQ(match("b*", 0, "abb", 3), "3,3");
+    ASSERT_STR_EQ(match("b", 0, "abb", 4), "none");
+}
+
+TEST(regexp_ignores_case_when_asked) {
+    ASSERT_STR_EQ(match("foo", 0, "a FoO", 0), "none");
+    ASSERT_STR_EQ(match("foo", REGEXP_ICASE, "a FoO", 0), "2,5");
+    ASSERT_STR_EQ(match("[a-c]+", REGEXP_ICASE, "xAbC", 0), "1,4");
+    /* Folded before negating: [^a] excludes A too */
+    ASSERT_STR_EQ(match("[^a]", REGEXP_ICASE, "aAb", 0), "2,3");
+    /* The literal start is skipped to in either case */
+    ASSERT_STR_EQ(match("ab-c\\d", REGEXP_ICASE, "ab-x Ab-C1", 0), "5,10");
+}
+
+/* ======================= Linear Time ======================================= */
+
+TEST(regexp_pathological_patterns_stay_linear) {
+    int n = 200000;
+    char *text = malloc((size_t)n + 2);
+    memset(text, 'a', (size_t)n);
+    text[n] = '\0';
+
+    /* Backtracking takes exponential time on these */
+    ASSERT_STR_EQ(match("(a*)*b", 0, text, 0), "none");
+    ASSERT_STR_EQ(match("(a|aa)+$", 0, text, 0), "0,200000");
+    ASSERT_STR_EQ(match("(x+x+)+y", 0, text, 0), "none");
+
+    /* Many DFA states: the cache is emptied and refilled */
+    text[n] = 'b';
+    text[n + 1] = '\0';
+    ASSERT_STR_EQ(match("a.{9}b", 0, text, 0), "199990,200001");
+    free(text);
+}
+
+TEST(regexp_search_reuses_the_compiled_pattern) {
+    const char *error;
+    Regexp *re = regexp_compile("[0-9]+", 0, &error);
+    ASSERT_NOT_NULL(re);
+    ASSERT_NULL(error);
+
+    const char *rows[] = {"abc", "x 42 y", "7", ""};
+    int found[4], start, end;
+    for (int i = 0; i < 4; i++)
+        found[i] = regexp_search(re, rows[i], (int)strlen(rows[i]), 0,
+                                 &start, &end);
+    ASSERT_EQ(found[0], 0);
+    ASSERT_EQ(found[1], 1);
+    ASSERT_EQ(found[2], 1);
+    ASSERT_EQ(found[3], 0);
+    regexp_free(re);
+}
+
+/* ======================= Errors ============================================ */
+
+TEST(regexp_rejects_invalid_patterns) {
+    const char *bad[] = {"a(", "a)", "[a", "*a", "a{2,1}", "a\\", "[z-a]",
+                         "a{1001}", "(a{1000}){1000}"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        const char *error = NULL;
+        Regexp *re = regexp_compile(bad[i], 0, &error);
+        ASSERT_NULL(re);
+        ASSERT_NOT_NULL(error);
+    }
+}
+
+BEGIN_TEST_SUITE("Regular Expressions")
+    /* Syntax */
+    RUN_TEST(regexp_matches_literals_and_classes);
+    RUN_TEST(regexp_repeats_and_alternates);
+
+    /* Which match */
+    RUN_TEST(regexp_prefers_leftmost_then_first_alternative);
+    RUN_TEST(regexp_lazy_repeats_take_the_shortest);
+    RUN_TEST(regexp_anchors_match_row_ends);
+    RUN_TEST(regexp_searches_from_offset);
+    RUN_TEST(regexp_ignores_case_when_asked);
+
+    /* Linear time */
+    RUN_TEST(regexp_pathological_patterns_stay_linear);
+    RUN_TEST(regexp_search_reuses_the_compiled_pattern);
+
+    /* Errors */
+    RUN_TEST(regexp_rejects_invalid_patterns);
+END_TEST_SUITE()
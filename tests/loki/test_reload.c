@@ -0,0 +1,138 @@
+/* test_reload.c - Unit tests for patching in a file changed on disk
+ *
+ * Tests for:
+ * - Only the lines that differ replaced, the cursor kept on its line
+ * - The reload undone in one step, unsaved changes coming back
+ * - A file emptied and written again
+ * - reload_tick() patching a clean buffer and leaving a dirty one
+ */
+
+#include "test_framework.h"
+#include "reload.h"
+#include "internal.h"
+#include "undo.h"
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+#define TEST_FILE "/tmp/loki_test_reload.txt"
+
+static void write_file(const char *text) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    fputs(text, fp);
+    fclose(fp);
+}
+
+static int cursor_row(editor_ctx_t *ctx) {
+    return ctx->view.rowoff + ctx->view.cy;
+}
+
+static void close_ctx(editor_ctx_t *ctx) {
+    editor_ctx_free(ctx);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);   /* Close the watch */
+    remove(TEST_FILE);
+}
+
+TEST(reload_patches_changed_lines) {
+    write_file("a\nb\nc\nd\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 10;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    ASSERT_NOT_NULL(ctx.model.watch);
+    ASSERT_EQ(reload_from_disk(&ctx), 0);
+
+    editor_cursor_to(&ctx, 3, 0);
+    write_file("a\nB\nc\nx\ny\nd\n");
+    ASSERT_EQ(reload_from_disk(&ctx), 3);
+    ASSERT_EQ(ctx.model.numrows, 6);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "B");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "x");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "y");
+    ASSERT_STR_EQ(ctx.model.row[5].chars, "d");
+    ASSERT_EQ(cursor_row(&ctx), 5);
+    ASSERT_EQ(ctx.model.dirty, 0);
+
+    /* Lines gone from the end */
+    write_file("a\nB\n");
+    ASSERT_EQ(reload_from_disk(&ctx), 4);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_EQ(cursor_row(&ctx), 1);
+
+    close_ctx(&ctx);
+}
+
+TEST(reload_undone_in_one_step) {
+    write_file("one\ntwo\nthree\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 10;
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+
+    /* An unsaved change, then the file changed in two places */
+    editor_insert_char(&ctx, 'x');
+    ASSERT_TRUE(ctx.model.dirty);
+    write_file("ONE\ntwo\nthree\nfour\n");
+    ASSERT_EQ(reload_from_disk(&ctx), 2);
+    ASSERT_EQ(ctx.model.numrows, 4);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ONE");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "four");
+    ASSERT_EQ(ctx.model.dirty, 0);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "xone");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "three");
+
+    close_ctx(&ctx);
+}
+
+TEST(reload_emptied_file) {
+    write_file("p\nq\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+
+    write_file("");
+    ASSERT_TRUE(reload_from_disk(&ctx) > 0);
+    ASSERT_TRUE(ctx.model.numrows <= 1);
+    ASSERT_EQ(reload_from_disk(&ctx), 0);
+
+    write_file("r\ns\n");
+    ASSERT_EQ(reload_from_disk(&ctx), 2);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "r");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "s");
+
+    close_ctx(&ctx);
+}
+
+TEST(reload_tick_patches_clean_buffers) {
+    write_file("a\nb\n");
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), 0);
+    uint64_t later = uv_hrtime() + (uint64_t)RELOAD_POLL_MS * 2000000;
+
+    /* Clean: patched */
+    write_file("a\nchanged\n");
+    reload_tick(&ctx, later);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "changed");
+
+    /* Dirty: left alone until :reload */
+    editor_insert_char(&ctx, 'z');
+    write_file("a\nchanged again\n");
+    reload_tick(&ctx, later * 2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "za");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "changed");
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, ":reload") != NULL);
+
+    close_ctx(&ctx);
+}
+
+BEGIN_TEST_SUITE("reload")
+    RUN_TEST(reload_patches_changed_lines);
+    RUN_TEST(reload_undone_in_one_step);
+    RUN_TEST(reload_emptied_file);
+    RUN_TEST(reload_tick_patches_clean_buffers);
+END_TEST_SUITE()
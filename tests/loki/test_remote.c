@@ -0,0 +1,209 @@
+/* test_remote.c - Unit tests for files read over ssh a block at a time
+ *
+ * The ssh run is a script that runs the command it is given here, and
+ * logs it, so the tests see what was asked of the host.
+ *
+ * Tests for:
+ * - Blocks fetched once, a run of missing blocks a request
+ * - A remote log opened with only the blocks of its first lines read
+ * - :N%, :N and searches fetching the blocks they read, and no more
+ * - The line index growing over the blocks present from the start
+ * - Missing files, unreachable hosts and malformed URLs
+ */
+
+#include "test_framework.h"
+#include "remote.h"
+#include "lazy.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_remote_test"
+#define TEST_SSH TEST_DIR "/ssh"
+#define TEST_LOG TEST_DIR "/log"
+#define TEST_FILE TEST_DIR "/big.log"
+#define TEST_URL "ssh://testhost" TEST_FILE
+#define TEST_LINES 700000       /* "line 0000000" and a newline: ~9 MB */
+
+static void setup(void) {
+    mkdir(TEST_DIR, 0755);
+    FILE *f = fopen(TEST_SSH, "w");
+    fputs("#!/bin/sh\n"
+          "while [ $# -gt 2 ]; do shift; done\n"
+          "[ \"$1\" = unreachable ] && exit 255\n"
+          "echo \"$2\" >> " TEST_LOG "\n"
+          "exec sh -c \"$2\"\n", f);
+    fclose(f);
+    chmod(TEST_SSH, 0755);
+    remote_set_ssh_program(TEST_SSH);
+    remove(TEST_LOG);
+}
+
+static void write_lines(void) {
+    FILE *f = fopen(TEST_FILE, "w");
+    for (int i = 0; i < TEST_LINES; i++) fprintf(f, "line %07d\n", i);
+    fclose(f);
+}
+
+/* Block reads logged since setup(), and the bytes they asked for */
+static int reads(size_t *bytes) {
+    FILE *f = fopen(TEST_LOG, "r");
+    int n = 0;
+    if (bytes) *bytes = 0;
+    if (f == NULL) return 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        const char *head = strstr(line, "head -c ");
+        if (strncmp(line, "tail", 4) != 0 || head == NULL) continue;
+        n++;
+        if (bytes) *bytes += strtoull(head + 8, NULL, 10);
+    }
+    fclose(f);
+    return n;
+}
+
+static const char *cursor_text(editor_ctx_t *ctx) {
+    return ctx->model.row[ctx->view.rowoff + ctx->view.cy].chars;
+}
+
+TEST(remote_fetches_missing_runs) {
+    setup();
+    FILE *f = fopen(TEST_FILE, "w");
+    for (size_t i = 0; i < REMOTE_BLOCK * 5 + 1000; i++) fputc('a' + (int)(i % 7), f);
+    fclose(f);
+
+    LoadedFile file;
+    char err[256];
+    RemoteFile *rf = remote_open(TEST_URL, &file, err, sizeof(err));
+    ASSERT_NOT_NULL(rf);
+    ASSERT_EQ(file.size, REMOTE_BLOCK * 5 + 1000);
+    RemoteStats st;
+    remote_stats(rf, &st);
+    ASSERT_EQ(st.nblocks, 6);
+    ASSERT_EQ(st.blocks, 0);
+    ASSERT_EQ(reads(NULL), 0);
+
+    /* One block for bytes in it, once */
+    size_t at = REMOTE_BLOCK * 3 + 10;
+    ASSERT_EQ(remote_fetch(rf, at, 100), 0);
+    ASSERT_EQ(remote_fetch(rf, at + 200, 100), 0);
+    ASSERT_EQ(file.data[at], 'a' + (int)(at % 7));
+    remote_stats(rf, &st);
+    ASSERT_EQ(st.requests, 1);
+    ASSERT_EQ(st.blocks, 1);
+    ASSERT_EQ(remote_prefix(rf), 0);
+
+    /* The rest: a request for each run around the block present */
+    ASSERT_EQ(remote_fetch(rf, 0, file.size), 0);
+    size_t bytes;
+    ASSERT_EQ(reads(&bytes), 3);
+    ASSERT_EQ(bytes, file.size);
+    ASSERT_EQ(remote_prefix(rf), file.size);
+    int same = 1;
+    for (size_t i = 0; i < file.size; i++) same &= file.data[i] == 'a' + (int)(i % 7);
+    ASSERT_TRUE(same);
+
+    loader_close(&file);
+    remote_close(rf);
+    remove(TEST_FILE);
+}
+
+TEST(remote_log_opens_with_its_first_block) {
+    setup();
+    write_lines();
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    ASSERT_EQ(editor_open(&ctx, TEST_URL), 0);
+    ASSERT_NOT_NULL(ctx.model.lazy);
+    ASSERT_EQ(ctx.model.numrows, LAZY_WINDOW_ROWS);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "line 0000000");
+    size_t bytes;
+    ASSERT_EQ(reads(&bytes), 1);
+    ASSERT_EQ(bytes, REMOTE_BLOCK);
+
+    /* Indexed as far as fetched */
+    lazy_wait_index(&ctx.model);
+    ASSERT_EQ(lazy_lines(&ctx.model), -1);
+    ASSERT_EQ(lazy_base(&ctx.model), 0);
+
+    /* :N% reads around the line, not the file before it */
+    lazy_goto_percent(&ctx, 90);
+    char text[32];
+    snprintf(text, sizeof(text), "%s", cursor_text(&ctx));
+    ASSERT_TRUE(strncmp(text, "line 06", 7) == 0);
+    ASSERT_TRUE(reads(&bytes) <= 3);
+    ASSERT_TRUE(bytes <= 3 * REMOTE_BLOCK);
+    ASSERT_EQ(lazy_base(&ctx.model), -1);
+
+    /* A search fetches as far as the match */
+    int line = atoi(text + 5), col, cols;
+    char query[32];
+    snprintf(query, sizeof(query), "line %07d", line + 20000);
+    int before = reads(NULL);
+    int row = lazy_find(&ctx, query, 12, 0, -1, 1, &col, &cols);
+    ASSERT_TRUE(row >= 0);
+    ASSERT_STR_EQ(ctx.model.row[row].chars, query);
+    ASSERT_TRUE(reads(NULL) <= before + 1);
+    editor_ctx_free(&ctx);
+    remove(TEST_FILE);
+}
+
+TEST(remote_goto_line_fetches_to_it) {
+    setup();
+    write_lines();
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 20;
+    ASSERT_EQ(editor_open_view(&ctx, TEST_URL), 0);
+
+    /* Past the index: scanned to, fetching the blocks on the way */
+    ASSERT_EQ(lazy_goto(&ctx, 300000), 300000);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 0300000");
+    size_t bytes;
+    reads(&bytes);
+    ASSERT_TRUE(bytes < (size_t)300000 * 13 + 2 * REMOTE_BLOCK);
+    lazy_wait_index(&ctx.model);
+    ASSERT_EQ(lazy_base(&ctx.model) + ctx.view.rowoff + ctx.view.cy, 300000);
+
+    /* All of it read: the index is done */
+    ASSERT_EQ(lazy_goto(&ctx, TEST_LINES + 5), TEST_LINES - 1);
+    ASSERT_STR_EQ(cursor_text(&ctx), "line 0699999");
+    lazy_wait_index(&ctx.model);
+    ASSERT_EQ(lazy_lines(&ctx.model), TEST_LINES);
+    reads(&bytes);
+    ASSERT_EQ(bytes, (size_t)TEST_LINES * 13);
+    ASSERT_TRUE(editor_refuse_edit(&ctx));
+    editor_ctx_free(&ctx);
+    remove(TEST_FILE);
+}
+
+TEST(remote_open_failures) {
+    setup();
+    LoadedFile file;
+    char err[256];
+    ASSERT_TRUE(remote_open("ssh://testhost" TEST_DIR "/none", &file, err, sizeof(err)) == NULL);
+    ASSERT_TRUE(strstr(err, "cannot read") != NULL);
+    ASSERT_TRUE(remote_open("ssh://unreachable/x", &file, err, sizeof(err)) == NULL);
+    ASSERT_TRUE(strstr(err, "cannot reach") != NULL);
+    ASSERT_TRUE(remote_open("ssh://testhost", &file, err, sizeof(err)) == NULL);
+    ASSERT_TRUE(strstr(err, "Not an ssh") != NULL);
+    ASSERT_TRUE(remote_is_url("https://example.com/x.log"));
+    ASSERT_FALSE(remote_is_url("/var/log/ssh://x"));
+
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, "ssh://testhost" TEST_DIR "/none"), -1);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "none") != NULL);
+    editor_ctx_free(&ctx);
+    remote_set_ssh_program(NULL);
+}
+
+BEGIN_TEST_SUITE("Remote")
+    RUN_TEST(remote_fetches_missing_runs);
+    RUN_TEST(remote_log_opens_with_its_first_block);
+    RUN_TEST(remote_goto_line_fetches_to_it);
+    RUN_TEST(remote_open_failures);
+END_TEST_SUITE()
@@ -0,0 +1,461 @@
+/* test_renderer.c - Unit tests for the terminal renderer
+ *
+ * Tests for:
+ * - Full repaint on the first frame and after invalidation
+ * - Frame diffing (unchanged frames, cursor moves, single-cell edits)
+ * - Wide characters taking two cells
+ * - Per-frame byte counters
+ * - Repeating undamaged rows instead of re-segmenting them
+ * - Vertical scrolls through a terminal scroll region
+ * - Synchronized output wrapping
+ */
+
+#include "test_framework.h"
+#include "renderer.h"
+#include "internal.h"
+#include "terminal.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCREEN_COLS 40
+#define SCREEN_ROWS 10
+
+/* Row editing function from core.c (declared locally, as in undo.c) */
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
+
+/* Helper: renderer writing into a temporary file */
+static Renderer *create_capturing_renderer(FILE **out) {
+    *out = tmpfile();
+    return *out ? terminal_renderer_create_fd(fileno(*out)) : NULL;
+}
+
+/* Helper: return what the renderer wrote since the last call */
+static void read_output(FILE *out, char *buf, size_t size) {
+    static off_t pos = 0;
+    int fd = fileno(out);
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < pos) pos = 0;  /* New capture file */
+    size_t len = (size_t)(end - pos);
+    if (len >= size) len = size - 1;
+    lseek(fd, pos, SEEK_SET);
+    ssize_t got = read(fd, buf, len);
+    buf[got > 0 ? got : 0] = '\0';
+    pos = lseek(fd, 0, SEEK_END);
+}
+
+/* Helper: draw a screen of numbered text rows with the cursor at (1, col) */
+static void draw_frame(Renderer *r, const char *first_row, int cursor_col) {
+    r->begin_frame(r, SCREEN_COLS, SCREEN_ROWS);
+    for (int y = 0; y < SCREEN_ROWS; y++) {
+        char text[32];
+        RenderSegment seg;
+        seg.text = text;
+        seg.len = snprintf(text, sizeof(text), "row %d text", y);
+        if (y == 0) {
+            seg.text = first_row;
+            seg.len = (int)strlen(first_row);
+        }
+        seg.hl_type = (y % 2) ? HL_TYPE_KEYWORD1 : HL_TYPE_NORMAL;
+        seg.selected = 0;
+        r->render_row(r, y + 1, &seg, 1, 4, 0);
+    }
+    StatusInfo info = {"NORMAL", "file.c", "", SCREEN_ROWS, 1, 0, 0, 0};
+    r->render_status(r, &info, SCREEN_COLS);
+    r->render_message(r, "", SCREEN_COLS);
+    r->set_cursor(r, 1, cursor_col);
+    r->end_frame(r);
+}
+
+TEST(first_frame_paints_whole_screen) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 5);
+
+    TerminalRenderStats stats;
+    terminal_renderer_get_stats(r, &stats);
+    ASSERT_EQ(stats.frames, 1);
+    ASSERT_TRUE(stats.frame_bytes > 0);
+
+    char buf[8192];
+    read_output(out, buf, sizeof(buf));
+    ASSERT_EQ(strlen(buf), stats.frame_bytes);
+    ASSERT_TRUE(strstr(buf, "\x1b[2J") != NULL);
+    ASSERT_TRUE(strstr(buf, "hello") != NULL);
+    ASSERT_TRUE(strstr(buf, "row 9 text") != NULL);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(unchanged_frame_writes_nothing) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 5);
+    draw_frame(r, "hello", 5);
+
+    TerminalRenderStats stats;
+    terminal_renderer_get_stats(r, &stats);
+    ASSERT_EQ(stats.frames, 2);
+    ASSERT_EQ(stats.frame_bytes, 0);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(cursor_move_only_moves_cursor) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 5);
+    char buf[8192];
+    read_output(out, buf, sizeof(buf));
+
+    draw_frame(r, "hello", 7);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_STR_EQ(buf, "\x1b[1;7H");
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(edit_emits_only_changed_cells) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 9);
+    TerminalRenderStats full;
+    terminal_renderer_get_stats(r, &full);
+    char buf[8192];
+    read_output(out, buf, sizeof(buf));
+
+    draw_frame(r, "hellxo", 10);
+    TerminalRenderStats diff;
+    terminal_renderer_get_stats(r, &diff);
+    read_output(out, buf, sizeof(buf));
+
+    /* Gutter is 4 columns: "hell" ends at column 8, "xo" starts at 9 */
+    ASSERT_TRUE(strstr(buf, "\x1b[1;9H") != NULL);
+    ASSERT_TRUE(strstr(buf, "xo") != NULL);
+    ASSERT_TRUE(strstr(buf, "hell") == NULL);
+    ASSERT_TRUE(strstr(buf, "row") == NULL);
+    ASSERT_TRUE(diff.frame_bytes * 10 < full.frame_bytes);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(wide_chars_take_two_cells) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    /* Two CJK characters, two cells each, then a blank */
+    draw_frame(r, "\xe6\x97\xa5\xe6\x9c\xac x", 5);
+    char buf[8192];
+    read_output(out, buf, sizeof(buf));
+
+    draw_frame(r, "\xe6\x97\xa5\xe6\x9c\xac y", 5);
+    read_output(out, buf, sizeof(buf));
+
+    /* Gutter is 4 columns, the characters 4 more: 'y' is at column 10 */
+    ASSERT_TRUE(strstr(buf, "\x1b[1;10H") != NULL);
+    ASSERT_TRUE(strstr(buf, "\xe6") == NULL);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(shorter_line_is_cleared_to_end) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello world", 5);
+    char buf[8192];
+    read_output(out, buf, sizeof(buf));
+
+    draw_frame(r, "hello", 5);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "\x1b[0K") != NULL);
+    ASSERT_TRUE(strstr(buf, "world") == NULL);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(invalidate_forces_full_repaint) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 5);
+    TerminalRenderStats first;
+    terminal_renderer_get_stats(r, &first);
+
+    terminal_renderer_invalidate(r);
+    draw_frame(r, "hello", 5);
+    TerminalRenderStats again;
+    terminal_renderer_get_stats(r, &again);
+    ASSERT_EQ(again.frame_bytes, first.frame_bytes);
+
+    /* A resize also repaints everything */
+    r->begin_frame(r, SCREEN_COLS + 1, SCREEN_ROWS);
+    r->end_frame(r);
+    terminal_renderer_get_stats(r, &again);
+    ASSERT_TRUE(again.frame_bytes > 0);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+/* Helper: editor with 'rows' numbered lines drawn through a capturing
+ * terminal renderer */
+static void init_drawn_ctx(editor_ctx_t *ctx, int rows, FILE **out) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = SCREEN_ROWS;
+    ctx->view.screencols = SCREEN_COLS;
+    for (int i = 0; i < rows; i++) {
+        char line[32];
+        int len = snprintf(line, sizeof(line), "line %d", i + 1);
+        editor_insert_row(ctx, i, line, len);
+    }
+    editor_ctx_set_renderer(ctx, create_capturing_renderer(out));
+}
+
+TEST(unchanged_rows_are_not_resegmented) {
+    editor_ctx_t ctx;
+    FILE *out;
+    init_drawn_ctx(&ctx, 30, &out);
+
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, SCREEN_ROWS);
+
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 0);
+    TerminalRenderStats stats;
+    terminal_renderer_get_stats(ctx.renderer, &stats);
+    ASSERT_EQ(stats.frame_bytes, 0);
+
+    editor_ctx_free(&ctx);
+    fclose(out);
+}
+
+TEST(edited_row_is_the_only_one_resegmented) {
+    editor_ctx_t ctx;
+    FILE *out;
+    init_drawn_ctx(&ctx, 30, &out);
+    char buf[8192];
+
+    editor_refresh_screen(&ctx);
+    read_output(out, buf, sizeof(buf));
+
+    editor_row_insert_char(&ctx, &ctx.model.row[3], 0, 'X');
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 1);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "Xline 4") != NULL);
+
+    /* Deleting a row moves every row below it */
+    editor_del_row(&ctx, 5);
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, SCREEN_ROWS - 5);
+
+    editor_ctx_free(&ctx);
+    fclose(out);
+}
+
+TEST(scrolling_resegments_only_exposed_rows) {
+    editor_ctx_t ctx;
+    FILE *out;
+    init_drawn_ctx(&ctx, 30, &out);
+    char buf[8192];
+
+    editor_refresh_screen(&ctx);
+    read_output(out, buf, sizeof(buf));
+
+    ctx.view.rowoff = 1;
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 1);
+
+    /* Repaint everything from the repeated rows to check their content */
+    terminal_renderer_invalidate(ctx.renderer);
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 0);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "line 2") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 11") != NULL);
+
+    ctx.view.rowoff = 0;
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 1);
+
+    editor_ctx_free(&ctx);
+    fclose(out);
+}
+
+TEST(selection_change_resegments_selected_rows) {
+    editor_ctx_t ctx;
+    FILE *out;
+    init_drawn_ctx(&ctx, 30, &out);
+
+    editor_refresh_screen(&ctx);
+
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_y = 4;
+    ctx.view.sel_start_x = 0;
+    ctx.view.sel_end_y = 2;
+    ctx.view.sel_end_x = 3;
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 3);
+
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 0);
+
+    ctx.view.sel_active = 0;
+    editor_refresh_screen(&ctx);
+    ASSERT_EQ(ctx.frame.rows_rebuilt, 3);
+
+    editor_ctx_free(&ctx);
+    fclose(out);
+}
+
+TEST(vertical_scroll_uses_scroll_region) {
+    editor_ctx_t ctx;
+    FILE *out;
+    init_drawn_ctx(&ctx, 30, &out);
+    char buf[8192];
+
+    editor_refresh_screen(&ctx);
+    read_output(out, buf, sizeof(buf));
+
+    ctx.view.rowoff = 2;
+    editor_refresh_screen(&ctx);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "\x1b[1;10r\x1b[2S\x1b[r") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 11") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 12") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 5") == NULL);
+
+    ctx.view.rowoff = 1;
+    editor_refresh_screen(&ctx);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "\x1b[1;10r\x1b[1T\x1b[r") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 2") != NULL);
+    ASSERT_TRUE(strstr(buf, "line 5") == NULL);
+
+    editor_ctx_free(&ctx);
+    fclose(out);
+}
+
+TEST(unrelated_frame_is_not_scrolled) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+    char buf[8192];
+
+    draw_frame(r, "hello", 5);
+    read_output(out, buf, sizeof(buf));
+    draw_frame(r, "world", 5);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, "\x1b[1;10r") == NULL);
+
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(synchronized_output_wraps_changed_frames) {
+    FILE *out;
+    Renderer *r = create_capturing_renderer(&out);
+    ASSERT_NOT_NULL(r);
+    char buf[8192];
+
+    terminal_set_sync_mode(TERM_SYNC_ON);
+    draw_frame(r, "hello", 5);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_EQ(strncmp(buf, TERM_SYNC_BEGIN, 8), 0);
+    ASSERT_STR_EQ(buf + strlen(buf) - 8, TERM_SYNC_END);
+
+    /* A cursor move alone is a single sequence, no wrapping needed */
+    draw_frame(r, "hello", 7);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_STR_EQ(buf, "\x1b[1;7H");
+
+    draw_frame(r, "hello", 7);
+    TerminalRenderStats stats;
+    terminal_renderer_get_stats(r, &stats);
+    ASSERT_EQ(stats.frame_bytes, 0);
+
+    terminal_set_sync_mode(TERM_SYNC_OFF);
+    draw_frame(r, "help", 7);
+    read_output(out, buf, sizeof(buf));
+    ASSERT_TRUE(strstr(buf, TERM_SYNC_BEGIN) == NULL);
+
+    terminal_set_sync_mode(TERM_SYNC_AUTO);
+    r->destroy(r);
+    fclose(out);
+}
+
+TEST(capture_renderer_keeps_output_and_cells) {
+    Renderer *r = capture_renderer_create();
+    ASSERT_NOT_NULL(r);
+
+    draw_frame(r, "hello", 5);
+    size_t len;
+    const char *out = capture_renderer_output(r, &len);
+    TerminalRenderStats stats;
+    terminal_renderer_get_stats(r, &stats);
+    ASSERT_EQ(len, stats.frame_bytes);
+    ASSERT_TRUE(stats.frame_escapes > 0);
+    ASSERT_EQ(stats.frame_escapes, stats.total_escapes);
+    ASSERT_NOT_NULL(memchr(out, '\x1b', len));
+
+    char line[SCREEN_COLS * 4 + 1];
+    ASSERT_TRUE(capture_renderer_line(r, 0, line, sizeof(line)) > 0);
+    ASSERT_NOT_NULL(strstr(line, "hello"));
+    ASSERT_TRUE(capture_renderer_line(r, 1000, line, sizeof(line)) < 0);
+
+    /* Odd rows are drawn as keywords */
+    ASSERT_TRUE(capture_renderer_line(r, 1, line, sizeof(line)) > 0);
+    int x = (int)(strstr(line, "row 1") - line);
+    CaptureCell cell;
+    ASSERT_EQ(capture_renderer_cell(r, 1, x, &cell), 0);
+    ASSERT_STR_EQ(cell.glyph, "r");
+    ASSERT_EQ(cell.hl, HL_TYPE_KEYWORD1);
+
+    /* Only the change is added to the output */
+    capture_renderer_clear(r);
+    draw_frame(r, "hellO", 5);
+    capture_renderer_output(r, &len);
+    terminal_renderer_get_stats(r, &stats);
+    ASSERT_EQ(len, stats.frame_bytes);
+    ASSERT_TRUE(len > 0 && len < 64);
+    ASSERT_TRUE(capture_renderer_line(r, 0, line, sizeof(line)) > 0);
+    ASSERT_NOT_NULL(strstr(line, "hellO"));
+
+    r->destroy(r);
+}
+
+BEGIN_TEST_SUITE("Renderer")
+    RUN_TEST(first_frame_paints_whole_screen);
+    RUN_TEST(unchanged_frame_writes_nothing);
+    RUN_TEST(cursor_move_only_moves_cursor);
+    RUN_TEST(edit_emits_only_changed_cells);
+    RUN_TEST(wide_chars_take_two_cells);
+    RUN_TEST(shorter_line_is_cleared_to_end);
+    RUN_TEST(invalidate_forces_full_repaint);
+    RUN_TEST(unchanged_rows_are_not_resegmented);
+    RUN_TEST(edited_row_is_the_only_one_resegmented);
+    RUN_TEST(scrolling_resegments_only_exposed_rows);
+    RUN_TEST(selection_change_resegments_selected_rows);
+    RUN_TEST(vertical_scroll_uses_scroll_region);
+    RUN_TEST(unrelated_frame_is_not_scrolled);
+    RUN_TEST(synchronized_output_wraps_changed_frames);
+    RUN_TEST(capture_renderer_keeps_output_and_cells);
+END_TEST_SUITE()
@@ -12,9 +12,16 @@
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
+#include "syntax.h"
 #include <string.h>
 #include <stdlib.h>
 
+/* Row editing functions from core.c (declared locally, as in undo.c) */
+void editor_del_row(editor_ctx_t *ctx, int at);
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
+void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at);
+void editor_row_append_string(editor_ctx_t *ctx, t_erow *row, char *s, size_t len);
+
 /* Helper: Initialize empty editor context */
 static void init_empty_ctx(editor_ctx_t *ctx) {
     editor_ctx_init(ctx);
@@ -34,8 +41,7 @@ static void init_ctx_with_rows(editor_ctx_t *ctx, int num_rows, const char **con
         ctx->model.row[i].size = strlen(content[i]);
         ctx->model.row[i].render = strdup(content[i]);
         ctx->model.row[i].rsize = strlen(content[i]);
-        ctx->model.row[i].hl = NULL;
-        ctx->model.row[i].idx = i;
+        ctx->model.row[i].hl_buf.hl = NULL;
     }
 }
 
@@ -52,7 +58,7 @@ TEST(row_insert_into_empty_buffer) {
     ASSERT_EQ(ctx.model.numrows, 1);
     ASSERT_STR_EQ(ctx.model.row[0].chars, "first line");
     ASSERT_EQ(ctx.model.row[0].size, 10);
-    ASSERT_EQ(ctx.model.row[0].idx, 0);
+    ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[0]), 0);
 
     editor_ctx_free(&ctx);
 }
@@ -69,8 +75,8 @@ TEST(row_insert_at_beginning) {
     ASSERT_STR_EQ(ctx.model.row[1].chars, "existing line");
 
     /* Verify indices updated */
-    ASSERT_EQ(ctx.model.row[0].idx, 0);
-    ASSERT_EQ(ctx.model.row[1].idx, 1);
+    ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[0]), 0);
+    ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[1]), 1);
 
     editor_ctx_free(&ctx);
 }
@@ -85,7 +91,7 @@ TEST(row_insert_at_end) {
     ASSERT_EQ(ctx.model.numrows, 2);
     ASSERT_STR_EQ(ctx.model.row[0].chars, "first line");
     ASSERT_STR_EQ(ctx.model.row[1].chars, "second line");
-    ASSERT_EQ(ctx.model.row[1].idx, 1);
+    ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[1]), 1);
 
     editor_ctx_free(&ctx);
 }
@@ -104,7 +110,7 @@ TEST(row_insert_in_middle) {
 
     /* Verify all indices */
     for (int i = 0; i < 3; i++) {
-        ASSERT_EQ(ctx.model.row[i].idx, i);
+        ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[i]), i);
     }
 
     editor_ctx_free(&ctx);
@@ -433,6 +439,140 @@ TEST(char_insert_into_long_line) {
     editor_ctx_free(&ctx);
 }
 
+/* Full tab expansion of a row, the way short rows are rendered */
+static char *expand_row(const t_erow *row, int *len) {
+    char *out = malloc((size_t)row->size * 8 + 1);
+    int idx = 0;
+    for (int j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            out[idx++] = ' ';
+            while ((idx + 1) % 8 != 0) out[idx++] = ' ';
+        } else {
+            out[idx++] = row->chars[j];
+        }
+    }
+    out[idx] = '\0';
+    *len = idx;
+    return out;
+}
+
+/* A row well past ROW_LONG_MIN with a TAB every 1000 chars */
+static void insert_huge_row(editor_ctx_t *ctx, int size) {
+    char *line = malloc(size);
+    for (int i = 0; i < size; i++)
+        line[i] = (i % 1000 == 999) ? '\t' : 'a' + i % 26;
+    editor_insert_row(ctx, 0, line, size);
+    free(line);
+}
+
+/* The window of a long row matches the same columns of a full render */
+static int window_matches(const t_erow *row) {
+    int full_len;
+    char *full = expand_row(row, &full_len);
+    int ok = row->render_off + row->rsize <= full_len &&
+             memcmp(row->render, full + row->render_off, row->rsize) == 0;
+    free(full);
+    return ok;
+}
+
+TEST(huge_row_renders_a_window) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    insert_huge_row(&ctx, 200000);
+
+    t_erow *row = &ctx.model.row[0];
+    ASSERT_NOT_NULL(row->colindex);
+    ASSERT_EQ(row->render_off, 0);
+    ASSERT_TRUE(row->rsize <= ROW_LONG_WINDOW + 8);
+    ASSERT_TRUE(row->rsize >= ROW_LONG_WINDOW);
+    ASSERT_TRUE(window_matches(row));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(visible_row_moves_the_window) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    insert_huge_row(&ctx, 200000);
+
+    t_erow *row = editor_visible_row(&ctx, 0, 150000, 80);
+    ASSERT_TRUE(row->render_off <= 150000);
+    ASSERT_TRUE(row->render_off + row->rsize >= 150080);
+    ASSERT_TRUE(window_matches(row));
+    ASSERT_NOT_NULL(row->hl_buf.hl);
+
+    /* Columns inside the window do not move it */
+    int off = row->render_off;
+    editor_visible_row(&ctx, 0, 150010, 80);
+    ASSERT_EQ(row->render_off, off);
+
+    /* The end of the line is covered by a short last window */
+    int full_len;
+    free(expand_row(row, &full_len));
+    editor_visible_row(&ctx, 0, full_len - 10, 80);
+    ASSERT_EQ(row->render_off + row->rsize, full_len);
+    ASSERT_TRUE(window_matches(row));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(edits_to_huge_row_keep_the_window) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    insert_huge_row(&ctx, 200000);
+
+    t_erow *row = editor_visible_row(&ctx, 0, 100000, 80);
+    int off = row->render_off;
+
+    /* A TAB early in the line shifts every column after it */
+    editor_row_insert_char(&ctx, row, 10, '\t');
+    ASSERT_EQ(row->render_off, off);
+    ASSERT_TRUE(window_matches(row));
+
+    editor_row_del_char(&ctx, row, 10);
+    editor_row_append_string(&ctx, row, (char *)"tail", 4);
+    ASSERT_EQ(row->size, 200004);
+    ASSERT_TRUE(window_matches(row));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(cx_to_rx_on_huge_row) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    insert_huge_row(&ctx, 200000);
+
+    t_erow *row = &ctx.model.row[0];
+    /* 999 chars then a TAB to the next stop at a multiple of 8 minus one */
+    ASSERT_EQ(editor_row_cx_to_rx(row, 999), 999);
+    ASSERT_EQ(editor_row_cx_to_rx(row, 1000), 1007);
+
+    int col = 0;
+    for (int j = 0; j < 123456; j++) {
+        col++;
+        if (row->chars[j] == '\t') while ((col + 1) % 8 != 0) col++;
+    }
+    ASSERT_EQ(editor_row_cx_to_rx(row, 123456), col);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(huge_row_shrinks_back_to_full_render) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    insert_huge_row(&ctx, ROW_LONG_MIN);
+
+    t_erow *row = editor_visible_row(&ctx, 0, 30000, 80);
+    ASSERT_TRUE(row->render_off > 0);
+
+    editor_row_del_char(&ctx, row, row->size - 1);
+    ASSERT_NULL(row->colindex);
+    ASSERT_EQ(row->render_off, 0);
+    ASSERT_TRUE(window_matches(row));
+
+    editor_ctx_free(&ctx);
+}
+
 /* ============================================================================
  * Multiple Row Operations
  * ============================================================================ */
@@ -453,7 +593,7 @@ TEST(multiple_insertions) {
         char expected[32];
         snprintf(expected, sizeof(expected), "line %d", i);
         ASSERT_STR_EQ(ctx.model.row[i].chars, expected);
-        ASSERT_EQ(ctx.model.row[i].idx, i);
+        ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[i]), i);
     }
 
     editor_ctx_free(&ctx);
@@ -536,6 +676,225 @@ TEST(unicode_aware_row) {
     editor_ctx_free(&ctx);
 }
 
+TEST(row_accessor_bounds) {
+    editor_ctx_t ctx;
+    const char *content[] = {"alpha", "beta"};
+    init_ctx_with_rows(&ctx, 2, content);
+
+    ASSERT_EQ(editor_numrows(&ctx), 2);
+    ASSERT_NOT_NULL(editor_row(&ctx, 0));
+    ASSERT_STR_EQ(editor_row(&ctx, 1)->chars, "beta");
+    ASSERT_NULL(editor_row(&ctx, -1));
+    ASSERT_NULL(editor_row(&ctx, 2));
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(row_index_follows_insert_and_delete) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+
+    const char *lines[] = {"int a;", "/* open", "x", "close */", "y"};
+    for (int i = 0; i < 5; i++)
+        editor_insert_row(&ctx, i, (char *)lines[i], strlen(lines[i]));
+
+    editor_del_row(&ctx, 0);
+    ASSERT_EQ(ctx.model.numrows, 4);
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ(editor_row_index(&ctx, &ctx.model.row[i]), i);
+
+    /* Re-highlighting "x" must see the row opening the comment as its previous row. */
+    editor_row_insert_char(&ctx, &ctx.model.row[1], 1, 'z');
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "xz");
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 1), 0), HL_MLCOMMENT);
+
+    /* Rows outside the model have no position. */
+    t_erow scratch = ctx.model.row[0];
+    ASSERT_EQ(editor_row_index(&ctx, &scratch), -1);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(highlight_is_computed_on_read) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+
+    for (int i = 0; i < 1000; i++)
+        editor_insert_row(&ctx, i, "int x;", 6);
+    /* Nothing has been read yet, so nothing has been highlighted. */
+    ASSERT_EQ((int)ctx.model.alloc_stats.hl, 0);
+    ASSERT_TRUE(ctx.model.row[999].hl_stale);
+
+    /* Reading the last row highlights everything above it once. */
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 999), 0), HL_KEYWORD2);
+    ASSERT_FALSE(ctx.model.row[500].hl_stale);
+
+    /* Opening a comment on row 0 does not cascade through the file... */
+    editor_row_insert_char(&ctx, &ctx.model.row[0], 0, '*');
+    editor_row_insert_char(&ctx, &ctx.model.row[0], 0, '/');
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 0), 0), HL_MLCOMMENT);
+    ASSERT_TRUE(ctx.model.row[1].hl_stale);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[500], 0), HL_KEYWORD2);
+
+    /* ...until a later row is read. */
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 500), 0), HL_MLCOMMENT);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(row_growth_is_amortized) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+
+    for (int i = 0; i < 1000; i++)
+        editor_insert_row(&ctx, i, "x", 1);
+
+    ASSERT_EQ(ctx.model.numrows, 1000);
+    ASSERT_TRUE(ctx.model.rowcap >= 1000);
+    /* Doubling from 16 rows: 16, 32, ..., 1024 */
+    ASSERT_TRUE(ctx.model.alloc_stats.row_array <= 8);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(typing_reuses_row_buffers) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+
+    for (int i = 0; i < 1000; i++)
+        editor_insert_char(&ctx, 'a');
+
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_EQ(ctx.model.row[0].size, 1000);
+    ASSERT_EQ(ctx.model.row[0].rsize, 1000);
+    ASSERT_TRUE(ctx.model.row[0].chars_cap > 1000);
+    /* Geometric growth: a handful of allocations, not one per keystroke */
+    ASSERT_TRUE(ctx.model.alloc_stats.chars < 16);
+    ASSERT_TRUE(ctx.model.alloc_stats.render < 16);
+    ASSERT_TRUE(ctx.model.alloc_stats.hl < 16);
+
+    editor_ctx_free(&ctx);
+}
+
+/* Helper: collect exported spans into a fixed buffer */
+struct span_sink {
+    char data[256];
+    size_t len;
+    int spans;
+};
+
+static int collect_span(const char *data, size_t len, void *arg) {
+    struct span_sink *sink = arg;
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    sink->spans++;
+    return 0;
+}
+
+TEST(export_walks_rows_as_spans) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    editor_insert_row(&ctx, 0, "one", 3);
+    editor_insert_row(&ctx, 1, "", 0);
+    editor_insert_row(&ctx, 2, "three", 5);
+
+    struct span_sink sink = {{0}, 0, 0};
+    ASSERT_EQ(editor_model_export(&ctx.model, EXPORT_NEWLINES, collect_span, &sink), 0);
+    ASSERT_EQ(sink.len, editor_model_export_size(&ctx.model, EXPORT_NEWLINES));
+    ASSERT_TRUE(memcmp(sink.data, "one\n\nthree\n", 11) == 0);
+    /* Spans point into the rows; the empty row contributes only "\n" */
+    ASSERT_EQ(sink.spans, 5);
+
+    struct span_sink raw = {{0}, 0, 0};
+    editor_model_export(&ctx.model, 0, collect_span, &raw);
+    ASSERT_EQ(raw.len, 8);
+    ASSERT_EQ(editor_model_export_size(&ctx.model, 0), 8);
+
+    size_t len;
+    const char *p = editor_model_read_at(&ctx.model, 2, 1, EXPORT_NEWLINES, &len);
+    ASSERT_TRUE(p == ctx.model.row[2].chars + 1);
+    ASSERT_EQ(len, 4);
+    p = editor_model_read_at(&ctx.model, 2, 5, EXPORT_NEWLINES, &len);
+    ASSERT_EQ(len, 1);
+    ASSERT_EQ(p[0], '\n');
+    editor_model_read_at(&ctx.model, 3, 0, EXPORT_NEWLINES, &len);
+    ASSERT_EQ(len, 0);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(segments_follow_highlight_and_selection) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    editor_insert_row(&ctx, 0, "int x = 42;", 11);
+    t_erow *row = syntax_fresh_row(&ctx, 0);
+    memset(row->hl_buf.hl, HL_NORMAL, row->rsize);
+    memset(row->hl_buf.hl, HL_KEYWORD1, 3);        /* "int" */
+    memset(row->hl_buf.hl + 8, HL_NUMBER, 2);      /* "42" */
+
+    RenderSegment *segs = NULL;
+    int cap = 0;
+    int n = editor_row_segments(&ctx, row, 0, 0, 80, &segs, &cap);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(segs[0].len, 3);
+    ASSERT_EQ(segs[0].hl_type, HL_TYPE_KEYWORD1);
+    ASSERT_EQ(segs[2].len, 2);
+    ASSERT_EQ(segs[2].hl_type, HL_TYPE_NUMBER);
+    ASSERT_TRUE(segs[2].text == row->render + 8);
+
+    /* Selection "x = 4", reversed endpoints, with the view scrolled by 1 */
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_y = 0;
+    ctx.view.sel_start_x = 9;
+    ctx.view.sel_end_y = 0;
+    ctx.view.sel_end_x = 4;
+    n = editor_row_segments(&ctx, row, 0, 1, 80, &segs, &cap);
+    ASSERT_EQ(n, 6);
+    ASSERT_EQ(segs[0].len, 2);              /* "nt" */
+    ASSERT_FALSE(segs[1].selected);         /* " " */
+    ASSERT_TRUE(segs[2].selected);          /* "x = " */
+    ASSERT_EQ(segs[2].len, 4);
+    ASSERT_TRUE(segs[3].selected);          /* "4" */
+    ASSERT_EQ(segs[3].hl_type, HL_TYPE_NUMBER);
+    ASSERT_FALSE(segs[4].selected);         /* "2" */
+    ASSERT_EQ(segs[4].hl_type, HL_TYPE_NUMBER);
+    ASSERT_EQ(segs[5].len, 1);              /* ";" */
+
+    free(segs);
+    editor_ctx_free(&ctx);
+}
+
+TEST(segments_are_not_truncated_on_busy_rows) {
+    editor_ctx_t ctx;
+    init_empty_ctx(&ctx);
+    char line[1000];
+    memset(line, 'a', sizeof(line));
+    editor_insert_row(&ctx, 0, line, sizeof(line));
+    t_erow *row = syntax_fresh_row(&ctx, 0);
+    unsigned char *hl = editor_row_hl(row);
+    for (int i = 0; i < row->rsize; i++)
+        hl[i] = (i % 2) ? HL_STRING : HL_NORMAL;
+
+    RenderSegment *segs = NULL;
+    int cap = 0;
+    int n = editor_row_segments(&ctx, row, 0, 0, 2000, &segs, &cap);
+    ASSERT_EQ(n, 1000);
+    int total = 0;
+    for (int i = 0; i < n; i++) total += segs[i].len;
+    ASSERT_EQ(total, 1000);
+
+    /* Clipped to the visible columns */
+    n = editor_row_segments(&ctx, row, 0, 0, 300, &segs, &cap);
+    ASSERT_EQ(n, 300);
+
+    free(segs);
+    editor_ctx_free(&ctx);
+}
+
 BEGIN_TEST_SUITE("Row Operations")
     /* Row insertion */
     RUN_TEST(row_insert_into_empty_buffer);
@@ -571,6 +930,11 @@ BEGIN_TEST_SUITE("Row Operations")
     /* Long lines */
     RUN_TEST(row_handles_long_line);
     RUN_TEST(char_insert_into_long_line);
+    RUN_TEST(huge_row_renders_a_window);
+    RUN_TEST(visible_row_moves_the_window);
+    RUN_TEST(edits_to_huge_row_keep_the_window);
+    RUN_TEST(cx_to_rx_on_huge_row);
+    RUN_TEST(huge_row_shrinks_back_to_full_render);
 
     /* Multiple operations */
     RUN_TEST(multiple_insertions);
@@ -581,4 +945,16 @@ BEGIN_TEST_SUITE("Row Operations")
     RUN_TEST(empty_buffer_operations);
     RUN_TEST(special_characters_in_row);
     RUN_TEST(unicode_aware_row);
+    RUN_TEST(row_accessor_bounds);
+    RUN_TEST(row_index_follows_insert_and_delete);
+    RUN_TEST(highlight_is_computed_on_read);
+
+    /* Allocation behaviour */
+    RUN_TEST(row_growth_is_amortized);
+    RUN_TEST(typing_reuses_row_buffers);
+
+    /* Document export */
+    RUN_TEST(export_walks_rows_as_spans);
+    RUN_TEST(segments_follow_highlight_and_selection);
+    RUN_TEST(segments_are_not_truncated_on_busy_rows);
 END_TEST_SUITE()
@@ -0,0 +1,213 @@
+/* test_rpc_server.c - Unit tests for the JSON-RPC harness over sockets
+ *
+ * Tests for:
+ * - Connections with sessions of their own
+ * - Sessions shared by name, and the notifications of their changes
+ * - TCP on a port picked by the system
+ * - A client that reads nothing until its responses pile up
+ *
+ * The clients are plain blocking sockets; the server's loop is run while
+ * they wait for an answer.
+ */
+
+#include "test_framework.h"
+#include "rpc_server.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_SOCKET "/tmp/loki_rpc_server_test.sock"
+
+static uv_loop_t loop;
+
+static RpcServer *start(const char *address) {
+    char err[256];
+    uv_loop_init(&loop);
+    remove(TEST_SOCKET);
+    EditorConfig config = {0};
+    RpcServer *server = rpc_server_start(&loop, address, &config, err, sizeof(err));
+    if (!server) fprintf(stderr, "%s\n", err);
+    return server;
+}
+
+static void stop(RpcServer *server) {
+    rpc_server_close(server);
+    uv_loop_close(&loop);
+}
+
+static int connect_unix(void) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, TEST_SOCKET);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Helper: Run the server until a line comes to 'fd', and return it (in a
+ * static buffer, without its newline), or NULL */
+static const char *recv_line(int fd) {
+    static char line[65536];
+    size_t len = 0;
+    for (int tries = 0; tries < 500; tries++) {
+        uv_run(&loop, UV_RUN_NOWAIT);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 2) <= 0) continue;
+        while (len < sizeof(line) - 1) {
+            if (read(fd, line + len, 1) != 1) return len ? line : NULL;
+            if (line[len] == '\n') {
+                line[len] = '\0';
+                return line;
+            }
+            len++;
+        }
+    }
+    return NULL;
+}
+
+/* Helper: Send a command and return its response */
+static const char *call(int fd, const char *cmd) {
+    if (write(fd, cmd, strlen(cmd)) < 0 || write(fd, "\n", 1) < 0) return NULL;
+    return recv_line(fd);
+}
+
+static int starts_with(const char *s, const char *prefix) {
+    return s && strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+static void pump(int times) {
+    for (int i = 0; i < times; i++) uv_run(&loop, UV_RUN_NOWAIT);
+}
+
+TEST(rpc_server_connections_have_their_own_sessions) {
+    RpcServer *server = start("unix:" TEST_SOCKET);
+    ASSERT_NOT_NULL(server);
+    int a = connect_unix(), b = connect_unix();
+    ASSERT_TRUE(a >= 0 && b >= 0);
+
+    ASSERT_STR_EQ(call(a, "{\"cmd\":\"event\",\"type\":\"key\",\"code\":105}"), "{\"ok\":true}");
+    ASSERT_STR_EQ(call(a, "{\"cmd\":\"status\"}"),
+                  "{\"ok\":true,\"mode\":\"insert\",\"filename\":null,\"dirty\":false}");
+    ASSERT_STR_EQ(call(b, "{\"cmd\":\"status\"}"),
+                  "{\"ok\":true,\"mode\":\"normal\",\"filename\":null,\"dirty\":false}");
+    ASSERT_EQ(rpc_server_clients(server), 2);
+
+    /* Frames are numbered per client */
+    ASSERT_TRUE(starts_with(call(a, "{\"cmd\":\"snapshot\"}"), "{\"ok\":true,\"frame\":1,"));
+    ASSERT_TRUE(starts_with(call(b, "{\"cmd\":\"snapshot\"}"), "{\"ok\":true,\"frame\":1,"));
+
+    ASSERT_STR_EQ(call(b, "{\"cmd\":\"quit\"}"), "{\"ok\":true}");
+    ASSERT_NULL(recv_line(b));      /* Closed after the answer */
+    ASSERT_EQ(rpc_server_clients(server), 1);
+    close(b);
+    close(a);
+    pump(10);
+    ASSERT_EQ(rpc_server_clients(server), 0);
+    stop(server);
+}
+
+TEST(rpc_server_shares_named_sessions) {
+    RpcServer *server = start("unix:" TEST_SOCKET);
+    ASSERT_NOT_NULL(server);
+    int a = connect_unix(), b = connect_unix();
+
+    ASSERT_STR_EQ(call(a, "{\"cmd\":\"attach\",\"session\":\"doc\"}"), "{\"ok\":true}");
+    ASSERT_STR_EQ(call(b, "{\"cmd\":\"attach\",\"session\":\"doc\"}"), "{\"ok\":true}");
+    const char *done = call(a, "[{\"cmd\":\"event\",\"type\":\"key\",\"code\":105},"
+                               "{\"cmd\":\"insert\",\"text\":\"shared\"}]");
+    ASSERT_TRUE(starts_with(done, "{\"ok\":true,\"done\":2,"));
+    ASSERT_STR_EQ(recv_line(b), "{\"event\":\"changed\",\"session\":\"doc\"}");
+    ASSERT_STR_EQ(call(b, "{\"cmd\":\"status\"}"),
+                  "{\"ok\":true,\"mode\":\"insert\",\"filename\":null,\"dirty\":true}");
+
+    /* The session outlives the client that made it */
+    close(a);
+    pump(10);
+    ASSERT_EQ(rpc_server_clients(server), 1);
+    int c = connect_unix();
+    ASSERT_STR_EQ(call(c, "{\"cmd\":\"attach\",\"session\":\"doc\"}"), "{\"ok\":true}");
+    ASSERT_STR_EQ(call(c, "{\"cmd\":\"status\"}"),
+                  "{\"ok\":true,\"mode\":\"insert\",\"filename\":null,\"dirty\":true}");
+    close(b);
+    close(c);
+    stop(server);
+}
+
+TEST(rpc_server_listens_on_tcp) {
+    RpcServer *server = start("tcp:127.0.0.1:0");
+    ASSERT_NOT_NULL(server);
+    int port = rpc_server_port(server);
+    ASSERT_TRUE(port > 0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    ASSERT_STR_EQ(call(fd, "{\"cmd\":\"status\"}"),
+                  "{\"ok\":true,\"mode\":\"normal\",\"filename\":null,\"dirty\":false}");
+    close(fd);
+    stop(server);
+
+    char err[256];
+    uv_loop_init(&loop);
+    ASSERT_NULL(rpc_server_start(&loop, "tcp:localhost", NULL, err, sizeof(err)));
+    ASSERT_NULL(rpc_server_start(&loop, "pipe", NULL, err, sizeof(err)));
+    uv_loop_close(&loop);
+}
+
+TEST(rpc_server_waits_for_a_slow_reader) {
+    RpcServer *server = start("unix:" TEST_SOCKET);
+    ASSERT_NOT_NULL(server);
+    int fd = connect_unix();
+
+    /* Whole frames, sent to a client that does not read them yet */
+    static char cmds[1000 * 20];
+    size_t len = 0;
+    for (int i = 0; i < 1000; i++) len += (size_t)sprintf(cmds + len, "{\"cmd\":\"snapshot\"}\n");
+    ASSERT_EQ((int)write(fd, cmds, len), (int)len);
+    pump(2000);
+
+    /* Every answer comes, in order, once it reads */
+    char buf[65536], last[32] = "";
+    int lines = 0;
+    size_t at = 0;
+    while (lines < 1000) {
+        uv_run(&loop, UV_RUN_NOWAIT);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) break;
+        ssize_t n = read(fd, buf + at, sizeof(buf) - at);
+        if (n <= 0) break;
+        at += (size_t)n;
+        char *line = buf, *nl;
+        while ((nl = memchr(line, '\n', (size_t)(buf + at - line)))) {
+            snprintf(last, sizeof(last), "%.*s", (int)(nl - line), line);
+            lines++;
+            line = nl + 1;
+        }
+        at = (size_t)(buf + at - line);
+        memmove(buf, line, at);
+    }
+    ASSERT_EQ(lines, 1000);
+    ASSERT_TRUE(starts_with(last, "{\"ok\":true,\"frame\":1000,"));
+    close(fd);
+    stop(server);
+}
+
+BEGIN_TEST_SUITE("RPC Server")
+    RUN_TEST(rpc_server_connections_have_their_own_sessions);
+    RUN_TEST(rpc_server_shares_named_sessions);
+    RUN_TEST(rpc_server_listens_on_tcp);
+    RUN_TEST(rpc_server_waits_for_a_slow_reader);
+END_TEST_SUITE()
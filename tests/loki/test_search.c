@@ -4,7 +4,7 @@
  * - Match finding (forward and backward)
  * - Navigation between matches
  * - Wrapping at file boundaries
- * - Case sensitivity
+ * - Case sensitivity, ignorecase and smartcase
  * - Multiple matches
  * - Edge cases (empty buffer, no match, etc.)
  */
@@ -12,8 +12,11 @@
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
+#include "search.h"
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* Helper: Create multi-line buffer with content */
 static void init_search_buffer(editor_ctx_t *ctx, int num_lines, const char **lines) {
@@ -27,8 +30,7 @@ static void init_search_buffer(editor_ctx_t *ctx, int num_lines, const char **li
         ctx->model.row[i].size = strlen(lines[i]);
         ctx->model.row[i].render = strdup(lines[i]);
         ctx->model.row[i].rsize = strlen(lines[i]);
-        ctx->model.row[i].hl = NULL;
-        ctx->model.row[i].idx = i;
+        ctx->model.row[i].hl_buf.hl = NULL;
     }
 
     ctx->view.screenrows = 24;
@@ -39,8 +41,8 @@ static void init_search_buffer(editor_ctx_t *ctx, int num_lines, const char **li
 static void free_search_buffer(editor_ctx_t *ctx) {
     for (int i = 0; i < ctx->model.numrows; i++) {
         free(ctx->model.row[i].chars);
-        free(ctx->model.row[i].render);
-        if (ctx->model.row[i].hl) free(ctx->model.row[i].hl);
+        if (ctx->model.row[i].render != ctx->model.row[i].chars) free(ctx->model.row[i].render);
+        if (ctx->model.row[i].hl_buf.hl) free(ctx->model.row[i].hl_buf.hl);
     }
     free(ctx->model.row);
     ctx->model.row = NULL;
@@ -519,6 +521,341 @@ TEST(search_backward_complete_wrap) {
     editor_ctx_free(&ctx);
 }
 
+/* ============================================================================
+ * Long Rows
+ * ============================================================================ */
+
+TEST(search_finds_match_past_long_row_window) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    /* Only a window of this row is rendered; the match is far past it */
+    int size = ROW_LONG_MIN * 2;
+    char *line = malloc(size);
+    memset(line, 'x', size);
+    line[10] = '\t';
+    memcpy(line + 100000, "needle", 6);
+    editor_insert_row(&ctx, 0, line, size);
+    free(line);
+
+    int match_offset = 0;
+    int result = editor_find_next_match(&ctx, "needle", -1, 1, &match_offset);
+
+    ASSERT_EQ(result, 0);
+    ASSERT_EQ(match_offset, 100000 + 4);  /* The TAB spans 5 columns */
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Compiled Patterns
+ * ============================================================================ */
+
+/* Both strategies agree with a plain scan, matches at the very end too */
+TEST(search_pattern_matches_naive_scan) {
+    char hay[300];
+    char needle[24];
+    unsigned int seed = 12345;
+
+    for (int round = 0; round < 2000; round++) {
+        int n = (int)(seed % sizeof(hay));
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245u + 12345u;
+            hay[i] = "ab\0c"[(seed >> 16) % 4];
+        }
+        seed = seed * 1103515245u + 12345u;
+        int m = 1 + (int)((seed >> 16) % (sizeof(needle) - 1));
+        int from = n > m ? (int)((seed >> 8) % (unsigned int)(n - m + 1)) : 0;
+        for (int i = 0; i < m; i++)
+            needle[i] = i + from < n ? hay[i + from] : 'a';
+
+        const char *expect = NULL;
+        for (int i = 0; i + m <= n && !expect; i++)
+            if (memcmp(hay + i, needle, (size_t)m) == 0) expect = hay + i;
+
+        SearchPattern pat;
+        search_pattern_init(&pat, needle, m);
+        ASSERT_TRUE(search_pattern_find(&pat, hay, (size_t)n) == expect);
+    }
+}
+
+/* Ignoring case agrees with a plain folded scan, on both strategies and
+ * with bytes that only look like letters once 0x20 is or-ed in */
+TEST(search_pattern_ignoring_case_matches_naive_scan) {
+    char hay[300];
+    char needle[24];
+    unsigned int seed = 54321;
+
+    for (int round = 0; round < 2000; round++) {
+        int n = (int)(seed % sizeof(hay));
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245u + 12345u;
+            hay[i] = "aAbB@`\0c"[(seed >> 16) % 8];
+        }
+        seed = seed * 1103515245u + 12345u;
+        int m = 1 + (int)((seed >> 16) % (sizeof(needle) - 1));
+        int from = n > m ? (int)((seed >> 8) % (unsigned int)(n - m + 1)) : 0;
+        for (int i = 0; i < m; i++) {
+            char c = i + from < n ? hay[i + from] : 'a';
+            /* Flip the case of some letters */
+            if (((seed >> i) & 1) && ((c | 0x20) == 'a' || (c | 0x20) == 'b'))
+                c ^= 0x20;
+            needle[i] = c;
+        }
+
+        const char *expect = NULL;
+        for (int i = 0; i + m <= n && !expect; i++) {
+            int j = 0;
+            while (j < m && tolower((unsigned char)hay[i + j]) ==
+                            tolower((unsigned char)needle[j])) j++;
+            if (j == m) expect = hay + i;
+        }
+
+        SearchPattern pat;
+        search_pattern_init_icase(&pat, needle, m, 1);
+        ASSERT_TRUE(search_pattern_find(&pat, hay, (size_t)n) == expect);
+    }
+}
+
+/* Two-byte UTF-8 letters fold too; other characters must match exactly */
+TEST(search_pattern_folds_utf8_letters) {
+    static const struct {
+        const char *needle, *hay;
+        int found;
+    } cases[] = {
+        {"\xc3\x89" "COLE", "une \xc3\xa9" "cole", 1},               /* ÉCOLE */
+        {"\xd0\x9f\xd1\x80\xd0\xb8", "\xd0\xbf\xd0\xa0\xd0\x98!", 1}, /* При */
+        {"\xce\xa3\xce\x9f\xce\xa6", "\xcf\x83\xce\xbf\xcf\x86", 1},  /* ΣΟΦ */
+        {"\xd0\x81\xd0\xb6", "\xd1\x91\xd0\x96", 1},                  /* Ёж */
+        {"\xc4\xbf", "\xc5\x80", 1},                                  /* Ŀ ŀ */
+        {"a\xc3\x97", "A\xc3\xb7", 0},                                /* × ÷ */
+        {"\xc3\xa9t\xc3\xa9", "\xc3\xa9t\xc3\xa8", 0},                /* été */
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        SearchPattern pat;
+        int m = (int)strlen(cases[i].needle);
+        search_pattern_init_icase(&pat, cases[i].needle, m, 1);
+        const char *hay = cases[i].hay;
+        const char *match = search_pattern_find(&pat, hay, strlen(hay));
+        ASSERT_EQ(match != NULL, cases[i].found);
+    }
+
+    /* Long enough for the vector filter, the match near the end */
+    char hay[200];
+    memset(hay, 'x', sizeof(hay));
+    memcpy(hay + 180, "\xd0\xbc\xd0\xb8\xd1\x80 ok", 9);
+    SearchPattern pat;
+    search_pattern_init_icase(&pat, "\xd0\x9c\xd0\x98\xd0\xa0 OK", 9, 1);
+    ASSERT_TRUE(search_pattern_find(&pat, hay, sizeof(hay)) == hay + 180);
+}
+
+/* Matches are found in chars and reported as render columns */
+TEST(search_maps_chars_match_to_render_column) {
+    const char *line = "\tint x;\t/* a long comment marker */";
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    editor_insert_row(&ctx, 0, (char *)line, strlen(line));
+    t_erow *row = &ctx.model.row[0];
+
+    SearchPattern pat;
+    search_pattern_init(&pat, "x", 1);
+    int col = search_row_find(&pat, row);
+    ASSERT_TRUE(col > 5);
+    ASSERT_EQ(row->render[col], 'x');
+
+    search_pattern_init(&pat, "long comment", 12);
+    col = search_row_find(&pat, row);
+    ASSERT_TRUE(col > 17);
+    ASSERT_EQ(memcmp(row->render + col, "long comment", 12), 0);
+
+    /* TAB expansion is not text: spaces do not match it */
+    search_pattern_init(&pat, "  int", 5);
+    ASSERT_EQ(search_row_find(&pat, row), -1);
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Match Sets
+ * ============================================================================ */
+
+/* A longer query narrows the set; backspace brings the shorter one back */
+TEST(search_cache_refines_as_the_query_grows) {
+    const char *lines[] = {"test tent", "team", "tester", "nothing"};
+    editor_ctx_t ctx;
+    init_search_buffer(&ctx, 4, lines);
+    SearchCache cache;
+    search_cache_init(&cache);
+
+    const SearchSet *set = search_cache_lookup(&cache, &ctx, "t", 1);
+    ASSERT_NOT_NULL(set);
+    ASSERT_EQ(set->n, 8);
+    set = search_cache_lookup(&cache, &ctx, "te", 2);
+    ASSERT_EQ(set->n, 5);
+    const SearchSet *tes = search_cache_lookup(&cache, &ctx, "tes", 3);
+    ASSERT_EQ(tes->n, 2);
+    ASSERT_EQ(tes->m[1].row, 2);
+    ASSERT_EQ(tes->m[1].off, 0);
+
+    /* Backspace and retype: nothing is searched again */
+    const SearchMatch *kept = tes->m;
+    ASSERT_TRUE(search_cache_lookup(&cache, &ctx, "te", 2) == set);
+    ASSERT_TRUE(search_cache_lookup(&cache, &ctx, "tes", 3) == tes);
+    ASSERT_TRUE(tes->m == kept);
+
+    /* A different last character drops the old set */
+    set = search_cache_lookup(&cache, &ctx, "ten", 3);
+    ASSERT_EQ(set->n, 1);
+    ASSERT_EQ(set->m[0].off, 5);
+
+    /* Edits drop every set */
+    ctx.model.row[3].chars[0] = 't';
+    ctx.model.row[3].chars[1] = 'e';
+    ctx.model.damage_gen++;
+    set = search_cache_lookup(&cache, &ctx, "te", 2);
+    ASSERT_EQ(set->n, 6);
+
+    ASSERT_NULL(search_cache_lookup(&cache, &ctx, "", 0));
+    search_cache_free(&cache);
+    free_search_buffer(&ctx);
+}
+
+/* Navigation goes to the first match of the next row, wrapping around */
+TEST(search_set_next_wraps_by_row) {
+    const char *lines[] = {"aa", "b", "a a", "b", "xa"};
+    editor_ctx_t ctx;
+    init_search_buffer(&ctx, 5, lines);
+    SearchCache cache;
+    search_cache_init(&cache);
+
+    const SearchSet *set = search_cache_lookup(&cache, &ctx, "a", 1);
+    ASSERT_EQ(set->n, 5);
+    ASSERT_EQ(set->m[search_set_next(set, -1, 1)].row, 0);
+    ASSERT_EQ(set->m[search_set_next(set, 0, 1)].row, 2);
+    ASSERT_EQ(set->m[search_set_next(set, 2, 1)].row, 4);
+    ASSERT_EQ(search_set_next(set, 4, 1), 0);
+
+    int i = search_set_next(set, 4, -1);
+    ASSERT_EQ(set->m[i].row, 2);
+    ASSERT_EQ(set->m[i].off, 0);
+    i = search_set_next(set, 0, -1);
+    ASSERT_EQ(set->m[i].row, 4);
+    ASSERT_EQ(set->m[i].off, 1);
+
+    set = search_cache_lookup(&cache, &ctx, "q", 1);
+    ASSERT_EQ(search_set_next(set, 0, 1), -1);
+
+    search_cache_free(&cache);
+    free_search_buffer(&ctx);
+}
+
+/* With ignorecase a query matches either case; with smartcase too, only
+ * a lower case one does */
+TEST(search_follows_ignorecase_and_smartcase) {
+    const char *lines[] = {"Test TEN", "team", "TESTER"};
+    editor_ctx_t ctx;
+    init_search_buffer(&ctx, 3, lines);
+    SearchCache cache;
+    search_cache_init(&cache);
+
+    ASSERT_EQ(search_ignores_case(&ctx, "te", 2, 0), 0);
+    ASSERT_EQ(search_cache_lookup(&cache, &ctx, "te", 2)->n, 1);
+
+    ctx.view.ignore_case = 1;
+    ASSERT_EQ(search_ignores_case(&ctx, "Te", 2, 0), 1);
+    const SearchSet *set = search_cache_lookup(&cache, &ctx, "te", 2);
+    ASSERT_EQ(set->n, 5);
+    ASSERT_EQ(search_cache_lookup(&cache, &ctx, "tes", 3)->n, 2);
+
+    /* An exact query refines the folded sets */
+    ctx.view.smart_case = 1;
+    ASSERT_EQ(search_ignores_case(&ctx, "te", 2, 0), 1);
+    ASSERT_EQ(search_ignores_case(&ctx, "tE", 2, 0), 0);
+    ASSERT_EQ(search_ignores_case(&ctx, "\xc3\x89t", 3, 0), 0);  /* Ét */
+    ASSERT_EQ(search_ignores_case(&ctx, "\\w\\S", 4, 1), 1);
+    ASSERT_EQ(search_ignores_case(&ctx, "\\wS", 3, 1), 0);
+    set = search_cache_lookup(&cache, &ctx, "teS", 3);
+    ASSERT_EQ(set->n, 0);
+    set = search_cache_lookup(&cache, &ctx, "TES", 3);
+    ASSERT_EQ(set->n, 1);
+    ASSERT_EQ(set->m[0].row, 2);
+
+    int off;
+    ASSERT_EQ(editor_find_next_match(&ctx, "ten", 0, 1, &off), 0);
+    ASSERT_EQ(off, 5);
+    ASSERT_EQ(editor_find_next_match(&ctx, "TEA", 0, 1, &off), -1);
+
+    SearchCount *sc = search_count_start(&ctx, "te", 2, 0);
+    while (search_count_total(sc) < 0) usleep(1000);
+    ASSERT_EQ(search_count_total(sc), 5);
+    search_count_free(sc);
+    sc = search_count_start(&ctx, "t.s", 3, 1);
+    while (search_count_total(sc) < 0) usleep(1000);
+    ASSERT_EQ(search_count_total(sc), 2);
+    search_count_free(sc);
+
+    search_cache_free(&cache);
+    free_search_buffer(&ctx);
+}
+
+/* ============================================================================
+ * Match Counting Tests
+ * ============================================================================ */
+
+/* Wait for a background count to finish */
+static int count_wait(SearchCount *sc) {
+    int total;
+    while ((total = search_count_total(sc)) < 0) usleep(1000);
+    return total;
+}
+
+TEST(search_count_counts_non_overlapping_matches) {
+    const char *lines[] = {"aaaa", "b", "xa a", "", "aaa"};
+    editor_ctx_t ctx;
+    init_search_buffer(&ctx, 5, lines);
+
+    SearchCount *sc = search_count_start(&ctx, "aa", 2, 0);
+    ASSERT_NOT_NULL(sc);
+    ASSERT_EQ(count_wait(sc), 3);
+    ASSERT_EQ(search_count_index(sc, 0, 2), 1);
+    ASSERT_EQ(search_count_index(sc, 4, 0), 2);
+    search_count_free(sc);
+
+    sc = search_count_start(&ctx, "a+", 2, 1);
+    ASSERT_NOT_NULL(sc);
+    ASSERT_EQ(count_wait(sc), 4);
+    ASSERT_EQ(search_count_index(sc, 2, 3), 2);
+    search_count_free(sc);
+
+    ASSERT_NULL(search_count_start(&ctx, "a(", 2, 1));
+    ASSERT_NULL(search_count_start(&ctx, "", 0, 0));
+    free_search_buffer(&ctx);
+}
+
+TEST(search_count_splits_large_buffers_across_threads) {
+    int n = SEARCH_COUNT_PARALLEL_ROWS * 3 + 16;
+    const char **lines = malloc(sizeof(char *) * (size_t)n);
+    for (int i = 0; i < n; i++) lines[i] = i % 3 == 0 ? "x key key" : "none";
+    editor_ctx_t ctx;
+    init_search_buffer(&ctx, n, lines);
+
+    SearchCount *sc = search_count_start(&ctx, "key", 3, 0);
+    ASSERT_NOT_NULL(sc);
+    int expect = ((n + 2) / 3) * 2;
+    ASSERT_EQ(count_wait(sc), expect);
+    /* Row n-1 is a match row: n-1 is a multiple of 3 */
+    ASSERT_EQ(search_count_index(sc, n - 1, 6), expect - 1);
+    search_count_free(sc);
+
+    /* Freeing a count that is still running stops it */
+    sc = search_count_start(&ctx, "k.y", 3, 1);
+    ASSERT_NOT_NULL(sc);
+    search_count_free(sc);
+
+    free_search_buffer(&ctx);
+    free(lines);
+}
+
 BEGIN_TEST_SUITE("Search")
     /* Basic search */
     RUN_TEST(search_find_simple_match);
@@ -557,4 +894,22 @@ BEGIN_TEST_SUITE("Search")
     /* Wrapping behavior */
     RUN_TEST(search_forward_complete_wrap);
     RUN_TEST(search_backward_complete_wrap);
+
+    /* Long rows */
+    RUN_TEST(search_finds_match_past_long_row_window);
+
+    /* Compiled patterns */
+    RUN_TEST(search_pattern_matches_naive_scan);
+    RUN_TEST(search_pattern_ignoring_case_matches_naive_scan);
+    RUN_TEST(search_pattern_folds_utf8_letters);
+    RUN_TEST(search_maps_chars_match_to_render_column);
+
+    /* Match sets */
+    RUN_TEST(search_cache_refines_as_the_query_grows);
+    RUN_TEST(search_set_next_wraps_by_row);
+    RUN_TEST(search_follows_ignorecase_and_smartcase);
+
+    /* Match counting */
+    RUN_TEST(search_count_counts_non_overlapping_matches);
+    RUN_TEST(search_count_splits_large_buffers_across_threads);
 END_TEST_SUITE()
@@ -0,0 +1,249 @@
+/* test_search_index.c - Unit tests for the trigram search index
+ *
+ * Tests for:
+ * - Row ranges and walking them with wrap-around
+ * - Lookups before and after the background build
+ * - Keeping up with inserted, deleted and changed rows
+ * - Dropping the index after too many edits
+ * - The bytes every regex match contains
+ * - Searches that only read the rows the index lists
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "search.h"
+#include "search_index.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define INDEX_ROWS 20000
+
+/* Rows "row N of the buffer", with "zebra" in rows 5 and 15000 */
+static void init_index_buffer(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    for (int i = 0; i < INDEX_ROWS; i++) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "row %d of the buffer%s", i,
+                         i == 5 || i == 15000 ? " (zebra)" : "");
+        editor_insert_row(ctx, i, line, (size_t)n);
+    }
+    search_index_enable(&ctx->model);
+    search_index_wait(&ctx->model);
+}
+
+/* Whether 'row' is in the ranges */
+static int ranges_have(const SearchRanges *rs, int row) {
+    int i = search_ranges_find(rs, row);
+    return i < rs->n && rs->r[i].first <= row;
+}
+
+/* ======================= Ranges ============================================ */
+
+TEST(search_ranges_join_and_wrap) {
+    SearchRanges rs = {NULL, 0, 0};
+    search_ranges_add(&rs, 2, 4);
+    search_ranges_add(&rs, 5, 6);    /* Joins the first */
+    search_ranges_add(&rs, 10, 10);
+    ASSERT_EQ(rs.n, 2);
+    ASSERT_EQ(rs.r[0].last, 6);
+    ASSERT_EQ(search_ranges_rows(&rs), 6);
+
+    ASSERT_EQ(search_ranges_find(&rs, 0), 0);
+    ASSERT_EQ(search_ranges_find(&rs, 7), 1);
+    ASSERT_EQ(search_ranges_find(&rs, 11), 2);
+
+    ASSERT_EQ(search_ranges_next(&rs, -1, 1), 2);
+    ASSERT_EQ(search_ranges_next(&rs, 3, 1), 4);
+    ASSERT_EQ(search_ranges_next(&rs, 6, 1), 10);
+    ASSERT_EQ(search_ranges_next(&rs, 10, 1), 2);     /* Wraps */
+    ASSERT_EQ(search_ranges_next(&rs, 10, -1), 6);
+    ASSERT_EQ(search_ranges_next(&rs, 4, -1), 3);
+    ASSERT_EQ(search_ranges_next(&rs, 2, -1), 10);    /* Wraps */
+    search_ranges_free(&rs);
+    ASSERT_EQ(search_ranges_next(&rs, 0, 1), -1);
+}
+
+/* ======================= Lookups =========================================== */
+
+TEST(search_index_lists_every_row_without_an_answer) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < 100; i++) editor_insert_row(&ctx, i, "text", 4);
+    SearchRanges rs = {NULL, 0, 0};
+
+    /* Not indexed */
+    ASSERT_EQ(search_index_lookup(&ctx.model, "text", 4, &rs), -1);
+    ASSERT_EQ(rs.n, 1);
+    ASSERT_EQ(search_ranges_rows(&rs), 100);
+
+    /* Too short to have a trigram */
+    search_index_enable(&ctx.model);
+    search_index_wait(&ctx.model);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "te", 2, &rs), -1);
+    ASSERT_EQ(search_ranges_rows(&rs), 100);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "text", 4, &rs), 0);
+
+    search_ranges_free(&rs);
+    editor_ctx_free(&ctx);
+}
+
+TEST(search_index_narrows_to_the_blocks_with_the_trigrams) {
+    editor_ctx_t ctx;
+    init_index_buffer(&ctx);
+    SearchRanges rs = {NULL, 0, 0};
+
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 5));
+    ASSERT_TRUE(ranges_have(&rs, 15000));
+    ASSERT_TRUE(search_ranges_rows(&rs) <= 4 * SEARCH_INDEX_BLOCK_MIN);
+
+    /* ASCII case is folded */
+    ASSERT_EQ(search_index_lookup(&ctx.model, "ZeBrA", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 15000));
+
+    /* Nowhere */
+    ASSERT_EQ(search_index_lookup(&ctx.model, "giraffe", 7, &rs), 0);
+    ASSERT_EQ(rs.n, 0);
+
+    /* In every row: too common to narrow anything */
+    ASSERT_EQ(search_index_lookup(&ctx.model, "buffer", 6, &rs), 0);
+    ASSERT_EQ(search_ranges_rows(&rs), INDEX_ROWS);
+
+    search_ranges_free(&rs);
+    editor_ctx_free(&ctx);
+}
+
+/* ======================= Edits ============================================= */
+
+TEST(search_index_follows_inserted_deleted_and_changed_rows) {
+    editor_ctx_t ctx;
+    init_index_buffer(&ctx);
+    SearchRanges rs = {NULL, 0, 0};
+
+    /* Rows above move the matches down */
+    editor_insert_row(&ctx, 0, "new first row", 13);
+    editor_insert_row(&ctx, 0, "another", 7);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 7));
+    ASSERT_TRUE(ranges_have(&rs, 15002));
+    ASSERT_TRUE(ranges_have(&rs, 0));       /* Inserted: searched in full */
+
+    /* ... and deleting them moves them back */
+    editor_del_row(&ctx, 0);
+    editor_del_row(&ctx, 0);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 5));
+    ASSERT_TRUE(ranges_have(&rs, 15000));
+    ASSERT_FALSE(ranges_have(&rs, 10000));
+
+    /* A changed row is searched in full */
+    t_erow *row = &ctx.model.row[10000];
+    editor_row_append_string(&ctx, row, " zebra", 6);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 10000));
+
+    /* What the search finds, going both ways */
+    int off;
+    ASSERT_EQ(editor_find_next_match(&ctx, "zebra", 5, 1, &off), 10000);
+    ASSERT_EQ(editor_find_next_match(&ctx, "zebra", 10000, 1, &off), 15000);
+    ASSERT_EQ(editor_find_next_match(&ctx, "zebra", 15000, 1, &off), 5);
+    ASSERT_EQ(editor_find_next_match(&ctx, "zebra", 5, -1, &off), 15000);
+
+    search_ranges_free(&rs);
+    editor_ctx_free(&ctx);
+}
+
+TEST(search_index_is_rebuilt_after_many_edits) {
+    editor_ctx_t ctx;
+    init_index_buffer(&ctx);
+    SearchRanges rs = {NULL, 0, 0};
+
+    /* Every other row changed: more runs than are tracked */
+    for (int i = 0; i < 2 * SEARCH_INDEX_MAX_RUNS + 4; i += 2)
+        editor_row_append_string(&ctx, &ctx.model.row[i], "!", 1);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), -1);
+    ASSERT_EQ(search_ranges_rows(&rs), INDEX_ROWS);
+
+    /* That lookup started the build again */
+    search_index_wait(&ctx.model);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(search_ranges_rows(&rs) <= 4 * SEARCH_INDEX_BLOCK_MIN);
+
+    /* Editing during a build stops it; unless it was done, the next
+     * lookup starts another */
+    search_index_enable(&ctx.model);
+    editor_insert_row(&ctx, 0, "zebra", 5);
+    search_index_lookup(&ctx.model, "zebra", 5, &rs);
+    search_index_wait(&ctx.model);
+    ASSERT_EQ(search_index_lookup(&ctx.model, "zebra", 5, &rs), 0);
+    ASSERT_TRUE(ranges_have(&rs, 0));
+
+    search_ranges_free(&rs);
+    editor_ctx_free(&ctx);
+}
+
+/* ======================= Regex Queries ===================================== */
+
+static const char *required(const char *pattern, int flags) {
+    static char buf[128];
+    const char *error, *lit;
+    Regexp *re = regexp_compile(pattern, flags, &error);
+    if (!re) return "(invalid)";
+    int n = regexp_required(re, &lit);
+    memcpy(buf, lit, (size_t)n);
+    buf[n] = '\0';
+    regexp_free(re);
+    return buf;
+}
+
+TEST(regexp_required_finds_bytes_every_match_has) {
+    ASSERT_STR_EQ(required("zebra", 0), "zebra");
+    ASSERT_STR_EQ(required("^x.*hello\\d+$", 0), "hello");
+    ASSERT_STR_EQ(required("a(bc|de)fghi", 0), "fghi");
+    ASSERT_STR_EQ(required("(?:abc)+xy", 0), "abcxy");
+    ASSERT_STR_EQ(required("ab{2}c", 0), "ab");
+    ASSERT_STR_EQ(required("Zebra", REGEXP_ICASE), "zebra");
+    ASSERT_STR_EQ(required("[zZ]ebra", 0), "zebra");
+    ASSERT_STR_EQ(required("x*abc?", 0), "ab");
+    ASSERT_STR_EQ(required("cat|dog", 0), "");
+    ASSERT_STR_EQ(required("\\w+", 0), "");
+}
+
+TEST(search_count_reads_only_listed_rows) {
+    editor_ctx_t ctx;
+    init_index_buffer(&ctx);
+
+    SearchCount *sc = search_count_start(&ctx, "zebra", 5, 0);
+    ASSERT_NOT_NULL(sc);
+    while (search_count_total(sc) < 0) {}
+    ASSERT_EQ(search_count_total(sc), 2);
+    ASSERT_EQ(search_count_index(sc, 15000, 0), 1);
+    search_count_free(sc);
+
+    sc = search_count_start(&ctx, "\\(z.bra\\)", 9, 1);
+    ASSERT_NOT_NULL(sc);
+    while (search_count_total(sc) < 0) {}
+    ASSERT_EQ(search_count_total(sc), 2);
+    search_count_free(sc);
+
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Search Index")
+    /* Ranges */
+    RUN_TEST(search_ranges_join_and_wrap);
+
+    /* Lookups */
+    RUN_TEST(search_index_lists_every_row_without_an_answer);
+    RUN_TEST(search_index_narrows_to_the_blocks_with_the_trigrams);
+
+    /* Edits */
+    RUN_TEST(search_index_follows_inserted_deleted_and_changed_rows);
+    RUN_TEST(search_index_is_rebuilt_after_many_edits);
+
+    /* Regex queries */
+    RUN_TEST(regexp_required_finds_bytes_every_match_has);
+    RUN_TEST(search_count_reads_only_listed_rows);
+END_TEST_SUITE()
@@ -2,9 +2,10 @@
  *
  * Tests for:
  * - is_selected() position checking (single-line and multi-line)
- * - base64_encode() encoding correctness
+ * - base64_encode() encoding correctness, whole and streamed in pieces
+ * - copy_selection_to_clipboard() streaming OSC 52 through the renderer
  * - get_selection_text() text extraction
- * - delete_selection() text removal
+ * - delete_selection() text removal, undone as one edit
  * - Selection boundary edge cases
  */
 
@@ -12,8 +13,10 @@
 #include "loki/core.h"
 #include "internal.h"
 #include "selection.h"
+#include "undo.h"
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 /* Helper: Create single-line test context */
 static void init_single_line_ctx(editor_ctx_t *ctx, const char *text) {
@@ -25,8 +28,7 @@ static void init_single_line_ctx(editor_ctx_t *ctx, const char *text) {
     ctx->model.row[0].size = strlen(text);
     ctx->model.row[0].render = strdup(text);
     ctx->model.row[0].rsize = strlen(text);
-    ctx->model.row[0].hl = NULL;
-    ctx->model.row[0].idx = 0;
+    ctx->model.row[0].hl_buf.hl = NULL;
 
     ctx->view.screenrows = 24;
     ctx->view.screencols = 80;
@@ -44,8 +46,7 @@ static void init_multiline_ctx(editor_ctx_t *ctx, int num_lines, const char **li
         ctx->model.row[i].size = strlen(lines[i]);
         ctx->model.row[i].render = strdup(lines[i]);
         ctx->model.row[i].rsize = strlen(lines[i]);
-        ctx->model.row[i].hl = NULL;
-        ctx->model.row[i].idx = i;
+        ctx->model.row[i].hl_buf.hl = NULL;
     }
 
     ctx->view.screenrows = 24;
@@ -229,6 +230,31 @@ TEST(selection_row_out_of_range) {
  * base64_encode() Tests
  * ============================================================================ */
 
+TEST(selection_row_span_resolves_columns) {
+    editor_ctx_t ctx;
+    init_single_line_ctx(&ctx, "hello world");
+
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_y = 3;
+    ctx.view.sel_start_x = 5;
+    ctx.view.sel_end_y = 1;
+    ctx.view.sel_end_x = 2;
+
+    int start, end;
+    ASSERT_TRUE(selection_row_span(&ctx, 1, &start, &end));
+    ASSERT_EQ(start, 2);
+    ASSERT_EQ(end, INT_MAX);
+    ASSERT_TRUE(selection_row_span(&ctx, 2, &start, &end));
+    ASSERT_EQ(start, 0);
+    ASSERT_EQ(end, INT_MAX);
+    ASSERT_TRUE(selection_row_span(&ctx, 3, &start, &end));
+    ASSERT_EQ(start, 0);
+    ASSERT_EQ(end, 5);
+    ASSERT_FALSE(selection_row_span(&ctx, 4, &start, &end));
+
+    editor_ctx_free(&ctx);
+}
+
 TEST(base64_encode_empty_string) {
     char *result = base64_encode("", 0);
     ASSERT_NOT_NULL(result);
@@ -278,6 +304,163 @@ TEST(base64_encode_binary_data) {
     free(result);
 }
 
+/* Helper: The plain encoder, one character at a time */
+static void reference_base64(const unsigned char *in, size_t len, char *out) {
+    static const char t[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t j = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) |
+                     (i + 2 < len ? in[i + 2] : 0);
+        out[j++] = t[v >> 18 & 63];
+        out[j++] = t[v >> 12 & 63];
+        out[j++] = i + 1 < len ? t[v >> 6 & 63] : '=';
+        out[j++] = i + 2 < len ? t[v & 63] : '=';
+    }
+    out[j] = '\0';
+}
+
+TEST(base64_encode_matches_reference_at_every_length) {
+    unsigned char in[64];
+    char want[BASE64_LEN(64) + 1], got[BASE64_LEN(64) + 1];
+    for (int i = 0; i < 64; i++) in[i] = (unsigned char)(i * 37 + 200);
+    for (size_t len = 0; len <= sizeof(in); len++) {
+        reference_base64(in, len, want);
+        size_t n = base64_encode_to((const char *)in, len, got);
+        ASSERT_EQ((int)n, (int)BASE64_LEN(len));
+        got[n] = '\0';
+        ASSERT_STR_EQ(got, want);
+    }
+}
+
+TEST(base64_stream_joins_pieces) {
+    unsigned char in[100];
+    char want[BASE64_LEN(100) + 1], got[BASE64_LEN(100) + 8];
+    for (int i = 0; i < 100; i++) in[i] = (unsigned char)(255 - i * 3);
+    reference_base64(in, sizeof(in), want);
+
+    /* Pieces of 1, 2, ... bytes: groups split every way */
+    for (size_t step = 1; step <= 7; step++) {
+        Base64Stream b64 = {{0}, 0};
+        size_t n = 0;
+        for (size_t i = 0; i < sizeof(in); i += step) {
+            size_t take = i + step <= sizeof(in) ? step : sizeof(in) - i;
+            n += base64_stream_feed(&b64, (const char *)in + i, take, got + n);
+        }
+        n += base64_stream_finish(&b64, got + n);
+        got[n] = '\0';
+        ASSERT_STR_EQ(got, want);
+    }
+}
+
+/* ============================================================================
+ * copy_selection_to_clipboard() Tests
+ * ============================================================================ */
+
+/* Helper: A renderer that keeps what is written to the terminal */
+static struct {
+    char *buf;
+    size_t len;
+    int writes;
+} raw;
+
+static int capture_write_raw(Renderer *r, const char *buf, size_t len) {
+    (void)r;
+    raw.buf = realloc(raw.buf, raw.len + len + 1);
+    memcpy(raw.buf + raw.len, buf, len);
+    raw.len += len;
+    raw.buf[raw.len] = '\0';
+    raw.writes++;
+    return 0;
+}
+
+TEST(copy_selection_streams_osc52) {
+    const char *lines[] = {"first line", "second", "third line"};
+    editor_ctx_t ctx;
+    init_multiline_ctx(&ctx, 3, lines);
+    Renderer r = {0};
+    r.write_raw = capture_write_raw;
+    ctx.renderer = &r;
+    raw.len = 0;
+    raw.writes = 0;
+
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_y = 2;       /* Reversed */
+    ctx.view.sel_start_x = 5;
+    ctx.view.sel_end_y = 0;
+    ctx.view.sel_end_x = 6;
+    copy_selection_to_clipboard(&ctx);
+
+    char want[64];
+    strcpy(want, "\033]52;c;");
+    reference_base64((const unsigned char *)"line\nsecond\nthird", 17, want + 7);
+    strcat(want, "\007");
+    ASSERT_STR_EQ(raw.buf, want);
+    ASSERT_FALSE(ctx.view.sel_active);
+    ASSERT_STR_EQ(ctx.view.statusmsg, "Copied 17 bytes to clipboard");
+
+    ctx.renderer = NULL;
+    editor_ctx_free(&ctx);
+}
+
+TEST(copy_selection_writes_large_rows_in_chunks) {
+    editor_ctx_t ctx;
+    size_t size = 3 * CLIPBOARD_CHUNK + 5;
+    char *line = malloc(size + 1);
+    for (size_t i = 0; i < size; i++) line[i] = (char)('a' + i % 26);
+    line[size] = '\0';
+    init_single_line_ctx(&ctx, line);
+    Renderer r = {0};
+    r.write_raw = capture_write_raw;
+    ctx.renderer = &r;
+    raw.len = 0;
+    raw.writes = 0;
+
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_x = 0;
+    ctx.view.sel_end_x = (int)size;
+    copy_selection_to_clipboard(&ctx);
+
+    char *want = malloc(BASE64_LEN(size) + 1);
+    reference_base64((const unsigned char *)line, size, want);
+    ASSERT_EQ((int)raw.len, (int)(7 + BASE64_LEN(size) + 1));
+    ASSERT_TRUE(memcmp(raw.buf + 7, want, BASE64_LEN(size)) == 0);
+    ASSERT_TRUE(raw.writes > 3);    /* The prefix, then chunks */
+
+    free(want);
+    free(line);
+    ctx.renderer = NULL;
+    editor_ctx_free(&ctx);
+}
+
+TEST(copy_selection_refuses_past_clipmax) {
+    editor_ctx_t ctx;
+    init_single_line_ctx(&ctx, "hello world");
+    Renderer r = {0};
+    r.write_raw = capture_write_raw;
+    ctx.renderer = &r;
+    raw.len = 0;
+    raw.writes = 0;
+
+    selection_set_clipboard_max(5);
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_x = 0;
+    ctx.view.sel_end_x = 11;
+    copy_selection_to_clipboard(&ctx);
+    ASSERT_EQ(raw.writes, 0);
+    ASSERT_TRUE(ctx.view.sel_active);   /* Kept, for a smaller copy */
+
+    selection_set_clipboard_max(0);
+    copy_selection_to_clipboard(&ctx);
+    ASSERT_EQ(raw.writes, 2);      /* The prefix, then the rest */
+    selection_set_clipboard_max(CLIPBOARD_MAX_DEFAULT);
+
+    free(raw.buf);
+    raw.buf = NULL;
+    ctx.renderer = NULL;
+    editor_ctx_free(&ctx);
+}
+
 /* ============================================================================
  * get_selection_text() Tests
  * ============================================================================ */
@@ -459,6 +642,32 @@ TEST(delete_selection_sets_dirty_flag) {
     editor_ctx_free(&ctx);
 }
 
+TEST(delete_selection_multi_line_undoes_as_one) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"first line", "second", "third line"};
+    init_multiline_ctx(&ctx, 3, lines);
+
+    ctx.view.sel_active = 1;
+    ctx.view.sel_start_x = 5;                  /* Selected backwards */
+    ctx.view.sel_start_y = 2;
+    ctx.view.sel_end_x = 5;
+    ctx.view.sel_end_y = 0;
+
+    int deleted = delete_selection(&ctx);
+    ASSERT_EQ(deleted, 18);                     /* " line\nsecond\nthird" */
+    ASSERT_EQ(ctx.model.numrows, 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "first line");
+    ASSERT_EQ(ctx.view.cx, 5);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "second");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "third line");
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    editor_ctx_free(&ctx);
+}
+
 /* ============================================================================
  * Edge Cases
  * ============================================================================ */
@@ -535,6 +744,7 @@ BEGIN_TEST_SUITE("Selection and Clipboard")
     RUN_TEST(selection_multiline_last_row);
     RUN_TEST(selection_multiline_reversed);
     RUN_TEST(selection_row_out_of_range);
+    RUN_TEST(selection_row_span_resolves_columns);
 
     /* base64_encode() */
     RUN_TEST(base64_encode_empty_string);
@@ -543,6 +753,13 @@ BEGIN_TEST_SUITE("Selection and Clipboard")
     RUN_TEST(base64_encode_three_chars);
     RUN_TEST(base64_encode_hello_world);
     RUN_TEST(base64_encode_binary_data);
+    RUN_TEST(base64_encode_matches_reference_at_every_length);
+    RUN_TEST(base64_stream_joins_pieces);
+
+    /* copy_selection_to_clipboard() */
+    RUN_TEST(copy_selection_streams_osc52);
+    RUN_TEST(copy_selection_writes_large_rows_in_chunks);
+    RUN_TEST(copy_selection_refuses_past_clipmax);
 
     /* get_selection_text() */
     RUN_TEST(get_selection_text_single_line);
@@ -557,6 +774,7 @@ BEGIN_TEST_SUITE("Selection and Clipboard")
     RUN_TEST(delete_selection_no_selection);
     RUN_TEST(delete_selection_clears_selection);
     RUN_TEST(delete_selection_sets_dirty_flag);
+    RUN_TEST(delete_selection_multi_line_undoes_as_one);
 
     /* Edge cases */
     RUN_TEST(selection_empty_buffer);
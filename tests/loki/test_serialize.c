@@ -25,17 +25,14 @@ static void setup_test_model(EditorModel *model) {
     model->row = calloc(3, sizeof(t_erow));
 
     /* Row 0: "Hello, World!" */
-    model->row[0].idx = 0;
     model->row[0].size = 13;
     model->row[0].chars = strdup("Hello, World!");
 
     /* Row 1: "" (empty) */
-    model->row[1].idx = 1;
     model->row[1].size = 0;
     model->row[1].chars = strdup("");
 
     /* Row 2: "Line 3" */
-    model->row[2].idx = 2;
     model->row[2].size = 6;
     model->row[2].chars = strdup("Line 3");
 }
@@ -48,8 +45,8 @@ static void cleanup_test_model(EditorModel *model) {
     }
     for (int i = 0; i < model->numrows; i++) {
         free(model->row[i].chars);
-        free(model->row[i].render);
-        free(model->row[i].hl);
+        if (model->row[i].render != model->row[i].chars) free(model->row[i].render);
+        free(model->row[i].hl_buf.hl);
     }
     free(model->row);
     model->row = NULL;
@@ -137,7 +134,6 @@ TEST(serialize_no_filename) {
 
     src.numrows = 1;
     src.row = calloc(1, sizeof(t_erow));
-    src.row[0].idx = 0;
     src.row[0].size = 4;
     src.row[0].chars = strdup("test");
 
@@ -268,6 +264,427 @@ TEST(deserialize_replaces_existing) {
     cleanup_test_model(&model);
 }
 
+/* Helper: read a whole file */
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc((size_t)size);
+    *len = fread(buf, 1, (size_t)size, f);
+    fclose(f);
+    return buf;
+}
+
+/* Test: Snapshot files are version 2 and deserialize as such */
+TEST(snapshot_version_2) {
+    EditorModel src, dst;
+    setup_test_model(&src);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    const char *path = "/tmp/test_loki_snapshot_v2.bin";
+    ASSERT_EQ(editor_model_save_snapshot(&src, path), 0);
+
+    size_t len = 0;
+    char *buf = read_file(path, &len);
+    ASSERT_NOT_NULL(buf);
+    ASSERT_EQ((unsigned char)buf[4], LOKI_SNAPSHOT_VERSION);
+
+    ASSERT_EQ(editor_model_deserialize(&dst, buf, len), 0);
+    ASSERT_STR_EQ(dst.filename, "test_file.txt");
+    ASSERT_EQ(dst.dirty, 1);
+    ASSERT_EQ(dst.numrows, 3);
+    ASSERT_STR_EQ(dst.row[0].chars, "Hello, World!");
+    ASSERT_EQ(dst.row[1].size, 0);
+    ASSERT_STR_EQ(dst.row[2].chars, "Line 3");
+
+    free(buf);
+    unlink(path);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: Mapped rows are used in place and copied when written */
+TEST(map_snapshot_in_place) {
+    EditorModel src, dst;
+    setup_test_model(&src);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    const char *path = "/tmp/test_loki_snapshot_map.bin";
+    ASSERT_EQ(editor_model_save_snapshot(&src, path), 0);
+    ASSERT_EQ(editor_model_map_snapshot(&dst, path), 0);
+    unlink(path);   /* The mapping keeps the contents */
+
+    ASSERT_STR_EQ(dst.filename, "test_file.txt");
+    ASSERT_EQ(dst.numrows, 3);
+    ASSERT_NOT_NULL(dst.row_map);
+    ASSERT_TRUE(dst.row[0].arena_bufs & ROW_BUF_MAPPED);
+    ASSERT_STR_EQ(dst.row[0].chars, "Hello, World!");
+    ASSERT_EQ(dst.row[1].size, 0);
+    ASSERT_STR_EQ(dst.row[1].chars, "");
+    ASSERT_STR_EQ(dst.row[2].chars, "Line 3");
+
+    /* Copy on write */
+    const char *mapped = dst.row[2].chars;
+    char *chars = editor_row_reserve(&dst, &dst.row[2], ROW_BUF_CHARS, 32, NULL);
+    ASSERT_TRUE(chars != mapped);
+    ASSERT_FALSE(dst.row[2].arena_bufs & ROW_BUF_MAPPED);
+    ASSERT_STR_EQ(dst.row[2].chars, "Line 3");
+    ASSERT_STR_EQ(dst.row[0].chars, "Hello, World!");
+
+    editor_model_free_rows(&dst);
+    ASSERT_NULL(dst.row_map);
+    free(dst.filename);
+    cleanup_test_model(&src);
+}
+
+/* Test: A snapshot whose row offsets don't hold up is refused */
+TEST(map_snapshot_corrupt) {
+    EditorModel src, dst;
+    setup_test_model(&src);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    const char *path = "/tmp/test_loki_snapshot_bad.bin";
+    ASSERT_EQ(editor_model_save_snapshot(&src, path), 0);
+    size_t len = 0;
+    char *buf = read_file(path, &len);
+    ASSERT_NOT_NULL(buf);
+    buf[len - 1] = 'x';     /* The last row's terminator */
+    FILE *f = fopen(path, "wb");
+    ASSERT_NOT_NULL(f);
+    fwrite(buf, 1, len, f);
+    fclose(f);
+
+    ASSERT_EQ(editor_model_map_snapshot(&dst, path), -1);
+    ASSERT_EQ(editor_model_deserialize(&dst, buf, len), -1);
+
+    free(buf);
+    unlink(path);
+    cleanup_test_model(&src);
+}
+
+/* Helper: collect editor_model_write_packed() output */
+typedef struct {
+    char *data;
+    size_t len;
+    int calls;
+} PackOut;
+
+static int collect(void *opaque, const void *data, size_t len) {
+    PackOut *out = opaque;
+    out->data = realloc(out->data, out->len + len);
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    out->calls++;
+    return 0;
+}
+
+/* Test: Packed snapshots round-trip across many blocks */
+TEST(packed_roundtrip) {
+    EditorModel src, dst;
+    memset(&src, 0, sizeof(EditorModel));
+    memset(&dst, 0, sizeof(EditorModel));
+    src.filename = strdup("big.txt");
+    src.dirty = 1;
+    int n = 20000;
+    src.row = calloc((size_t)n, sizeof(t_erow));
+    src.numrows = src.rowcap = n;
+    char line[64];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "row %d of the packed test", i);
+        src.row[i].chars = strdup(line);
+        src.row[i].size = len;
+        src.row[i].hl_stale = 1;
+    }
+    src.hl_stale_from = 0;
+
+    PackOut out = { NULL, 0, 0 };
+    ASSERT_EQ(editor_model_write_packed(&src, collect, &out), 0);
+    ASSERT_TRUE(out.calls > 4);                     /* Several blocks */
+    ASSERT_TRUE(out.len < (size_t)n * 20);          /* Compressed */
+    ASSERT_EQ((unsigned char)out.data[4], LOKI_PACK_VERSION);
+
+    ASSERT_EQ(editor_model_deserialize(&dst, out.data, out.len), 0);
+    ASSERT_STR_EQ(dst.filename, "big.txt");
+    ASSERT_EQ(dst.dirty, 1);
+    ASSERT_EQ(dst.numrows, n);
+    ASSERT_STR_EQ(dst.row[0].chars, "row 0 of the packed test");
+    ASSERT_STR_EQ(dst.row[n - 1].chars, "row 19999 of the packed test");
+    ASSERT_EQ(dst.row[12345].size, (int)strlen("row 12345 of the packed test"));
+    ASSERT_EQ(dst.row[0].hl_stale, 1);
+    ASSERT_EQ(dst.hl_stale_from, 0);
+
+    free(out.data);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: Fresh rows keep their highlight through a packed snapshot */
+TEST(packed_keeps_highlight) {
+    EditorModel src, dst;
+    setup_test_model(&src);
+    memset(&dst, 0, sizeof(EditorModel));
+    t_erow *row = &src.row[0];
+    row->render = strdup(row->chars);
+    row->rsize = row->size;
+    row->hl_buf.hl = malloc((size_t)row->rsize);
+    memset(row->hl_buf.hl, HL_KEYWORD1, (size_t)row->rsize);
+    row->hl_oc = 1;
+    row->hl_stale = 0;
+    src.row[1].hl_stale = 1;
+    src.row[2].hl_stale = 1;
+    src.hl_stale_from = 1;
+
+    const char *path = "/tmp/test_loki_packed.bin";
+    ASSERT_EQ(editor_model_save_packed(&src, path), 0);
+    ASSERT_EQ(editor_model_load_snapshot(&dst, path), 0);
+    unlink(path);
+
+    ASSERT_EQ(dst.numrows, 3);
+    ASSERT_EQ(dst.row[0].hl_stale, 0);
+    ASSERT_EQ(dst.row[0].hl_oc, 1);
+    ASSERT_EQ(dst.row[0].rsize, src.row[0].size);
+    ASSERT_STR_EQ(dst.row[0].render, "Hello, World!");
+    ASSERT_EQ(editor_row_hl_at(&dst.row[0], 0), HL_KEYWORD1);
+    ASSERT_EQ(dst.row[1].hl_stale, 1);
+    ASSERT_NULL(dst.row[1].render);
+    ASSERT_STR_EQ(dst.row[2].chars, "Line 3");
+    ASSERT_EQ(dst.hl_stale_from, 1);
+
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: A damaged block fails its checksum */
+TEST(packed_checksum) {
+    EditorModel src, dst;
+    setup_test_model(&src);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    PackOut out = { NULL, 0, 0 };
+    ASSERT_EQ(editor_model_write_packed(&src, collect, &out), 0);
+    out.data[out.len - 16 - 3] ^= 0x20;     /* In the last row's text */
+    ASSERT_EQ(editor_model_deserialize(&dst, out.data, out.len), -1);
+    ASSERT_EQ(dst.numrows, 0);
+    ASSERT_EQ(editor_model_deserialize(&dst, out.data, out.len - 16), -1);
+
+    free(out.data);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Helper: A model of 'n' numbered rows, for checkpoints */
+static void setup_numbered_model(EditorModel *model, int n) {
+    memset(model, 0, sizeof(EditorModel));
+    model->filename = strdup("checkpoint.txt");
+    model->edit_gen = 1;
+    model->row = calloc((size_t)n, sizeof(t_erow));
+    model->numrows = model->rowcap = n;
+    model->hl_stale_from = 0;
+    char line[64];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(line, sizeof(line), "line %d of the checkpoint test", i);
+        model->row[i].chars = strdup(line);
+        model->row[i].size = len;
+        model->row[i].hl_stale = 1;
+    }
+}
+
+/* Helper: Change a row's text, as editing does */
+static void set_row_text(EditorModel *model, int at, const char *text) {
+    t_erow *row = &model->row[at];
+    free(row->chars);
+    row->chars = strdup(text);
+    row->size = (int)strlen(text);
+    row->edit_gen = model->edit_gen;
+}
+
+/* Helper: Insert a row, as editing does */
+static void insert_row_text(EditorModel *model, int at, const char *text) {
+    model->row = realloc(model->row, sizeof(t_erow) * (size_t)(model->numrows + 1));
+    memmove(&model->row[at + 1], &model->row[at],
+            sizeof(t_erow) * (size_t)(model->numrows - at));
+    memset(&model->row[at], 0, sizeof(t_erow));
+    model->numrows++;
+    model->rowcap = model->numrows;
+    model->row[at].chars = NULL;
+    model->row[at].hl_stale = 1;
+    set_row_text(model, at, text);
+}
+
+/* Helper: Delete a row, as editing does */
+static void delete_row(EditorModel *model, int at) {
+    free(model->row[at].chars);
+    memmove(&model->row[at], &model->row[at + 1],
+            sizeof(t_erow) * (size_t)(model->numrows - at - 1));
+    model->numrows--;
+}
+
+/* Helper: Whether two models hold the same text */
+static int same_text(const EditorModel *a, const EditorModel *b) {
+    if (a->numrows != b->numrows) return 0;
+    for (int i = 0; i < a->numrows; i++) {
+        if (a->row[i].size != b->row[i].size ||
+            memcmp(a->row[i].chars, b->row[i].chars, (size_t)a->row[i].size) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Test: Checkpoints after the first write the changed rows only */
+TEST(checkpoint_deltas) {
+    const char *path = "/tmp/test_loki_checkpoint.bin";
+    unlink(path);
+    EditorModel src, dst;
+    setup_numbered_model(&src, 5000);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    SnapshotCheckpoint *cp = snapshot_checkpoint_open(path);
+    ASSERT_NOT_NULL(cp);
+    long long base = snapshot_checkpoint_write(cp, &src);
+    ASSERT_TRUE(base > 0);
+
+    set_row_text(&src, 10, "changed line ten");
+    insert_row_text(&src, 2000, "a new line");
+    delete_row(&src, 4000);
+    src.dirty = 1;
+    long long delta = snapshot_checkpoint_write(cp, &src);
+    ASSERT_TRUE(delta > 0);
+    ASSERT_TRUE(delta < 200);                       /* Not the text again */
+
+    set_row_text(&src, 0, "first");
+    set_row_text(&src, src.numrows - 1, "last");
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+
+    SnapshotCheckpointStats st;
+    snapshot_checkpoint_get_stats(cp, &st);
+    ASSERT_EQ((int)st.bases, 1);
+    ASSERT_EQ((int)st.deltas, 2);
+    ASSERT_EQ((long long)st.base_bytes, base);
+    snapshot_checkpoint_close(cp);
+
+    ASSERT_EQ(editor_model_load_snapshot(&dst, path), 0);
+    ASSERT_TRUE(same_text(&src, &dst));
+    ASSERT_STR_EQ(dst.filename, "checkpoint.txt");
+    ASSERT_EQ(dst.dirty, 1);
+    ASSERT_STR_EQ(dst.row[2000].chars, "a new line");
+    ASSERT_EQ(dst.row[0].hl_stale, 1);
+
+    unlink(path);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: A delta cut short is left out, and the ones before it kept */
+TEST(checkpoint_torn_delta) {
+    const char *path = "/tmp/test_loki_checkpoint_torn.bin";
+    unlink(path);
+    EditorModel src, dst;
+    setup_numbered_model(&src, 100);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    SnapshotCheckpoint *cp = snapshot_checkpoint_open(path);
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    set_row_text(&src, 50, "kept");
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    set_row_text(&src, 60, "lost");
+    long long last = snapshot_checkpoint_write(cp, &src);
+    ASSERT_TRUE(last > 0);
+    snapshot_checkpoint_close(cp);
+
+    FILE *f = fopen(path, "rb");
+    ASSERT_NOT_NULL(f);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    ASSERT_EQ(truncate(path, size - last / 2), 0);
+
+    ASSERT_EQ(editor_model_load_snapshot(&dst, path), 0);
+    ASSERT_EQ(dst.numrows, 100);
+    ASSERT_STR_EQ(dst.row[50].chars, "kept");
+    ASSERT_STR_EQ(dst.row[60].chars, "line 60 of the checkpoint test");
+
+    unlink(path);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: Replaced rows, or most rows changed, start a new base */
+TEST(checkpoint_rebase) {
+    const char *path = "/tmp/test_loki_checkpoint_rebase.bin";
+    unlink(path);
+    EditorModel src, dst;
+    setup_numbered_model(&src, 10);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    SnapshotCheckpoint *cp = snapshot_checkpoint_open(path);
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    for (int i = 0; i < 8; i++) set_row_text(&src, i, "rewritten");
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    src.snap_gen = 0;                               /* As loading a file does */
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+
+    SnapshotCheckpointStats st;
+    snapshot_checkpoint_get_stats(cp, &st);
+    ASSERT_EQ((int)st.bases, 3);
+    ASSERT_EQ((int)st.deltas, 0);
+    snapshot_checkpoint_close(cp);
+
+    ASSERT_EQ(editor_model_load_snapshot(&dst, path), 0);
+    ASSERT_TRUE(same_text(&src, &dst));
+
+    unlink(path);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
+/* Test: Deltas past the base are compacted into a new one */
+TEST(checkpoint_compaction) {
+    const char *path = "/tmp/test_loki_checkpoint_compact.bin";
+    unlink(path);
+    EditorModel src, dst;
+    setup_numbered_model(&src, 200);
+    memset(&dst, 0, sizeof(EditorModel));
+
+    SnapshotCheckpoint *cp = snapshot_checkpoint_open(path);
+    snapshot_checkpoint_set_compact_min(cp, 1);
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    SnapshotCheckpointStats st;
+    char line[64];
+    int i = 0;
+    do {
+        snprintf(line, sizeof(line), "edit %d", i);
+        set_row_text(&src, (i * 37) % 200, line);
+        ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+        snapshot_checkpoint_get_stats(cp, &st);
+        i++;
+    } while (!st.compacting && i < 1000);
+    ASSERT_EQ(st.compacting, 1);
+
+    /* Deltas written while it runs go after the new base */
+    set_row_text(&src, 199, "during");
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    for (int tries = 0; st.compacting && tries < 1000; tries++) {
+        usleep(1000);
+        snapshot_checkpoint_get_stats(cp, &st);
+    }
+    ASSERT_EQ(st.compacting, 0);
+    ASSERT_EQ((int)st.compactions, 1);
+    ASSERT_TRUE(st.delta_bytes < st.base_bytes);
+    set_row_text(&src, 0, "after");
+    ASSERT_TRUE(snapshot_checkpoint_write(cp, &src) > 0);
+    snapshot_checkpoint_close(cp);
+
+    ASSERT_EQ(editor_model_load_snapshot(&dst, path), 0);
+    ASSERT_TRUE(same_text(&src, &dst));
+    ASSERT_STR_EQ(dst.row[199].chars, "during");
+
+    unlink(path);
+    cleanup_test_model(&src);
+    cleanup_test_model(&dst);
+}
+
 BEGIN_TEST_SUITE("EditorModel Serialization")
     RUN_TEST(serialize_size_empty);
     RUN_TEST(serialize_size_with_data);
@@ -281,4 +698,14 @@ BEGIN_TEST_SUITE("EditorModel Serialization")
     RUN_TEST(serialize_to_buf);
     RUN_TEST(serialize_to_small_buf);
     RUN_TEST(deserialize_replaces_existing);
+    RUN_TEST(snapshot_version_2);
+    RUN_TEST(map_snapshot_in_place);
+    RUN_TEST(map_snapshot_corrupt);
+    RUN_TEST(packed_roundtrip);
+    RUN_TEST(packed_keeps_highlight);
+    RUN_TEST(packed_checksum);
+    RUN_TEST(checkpoint_deltas);
+    RUN_TEST(checkpoint_torn_delta);
+    RUN_TEST(checkpoint_rebase);
+    RUN_TEST(checkpoint_compaction);
 END_TEST_SUITE()
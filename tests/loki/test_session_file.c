@@ -0,0 +1,195 @@
+/* test_session_file.c - Unit tests for sessions
+ *
+ * Tests for:
+ * - The session format: a round trip, and truncated data refused
+ * - Buffers saved and opened again unread, the one shown read at once,
+ *   cursors and folds put back when they are shown
+ * - Unsaved changes and unnamed buffers back from their snapshots, and
+ *   snapshots no longer needed removed
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_framework.h"
+#include "internal.h"
+#include "buffers.h"
+#include "fold.h"
+#include "session_file.h"
+#include "undo_journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEST_DIR "/tmp/loki_session_test"
+#define SESSION TEST_DIR "/s.loki"
+
+static const char *write_file(const char *name, const char *content) {
+    static char path[256];
+    mkdir(TEST_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/%s", TEST_DIR, name);
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fputs(content, f);
+        fclose(f);
+    }
+    return path;
+}
+
+static void init_test_context(editor_ctx_t *ctx) {
+    memset(ctx, 0, sizeof(editor_ctx_t));
+    ctx->view.mode = MODE_NORMAL;
+    ctx->view.screencols = 80;
+    ctx->view.screenrows = 24;
+}
+
+TEST(session_format_round_trip) {
+    SessionFold folds[2] = { { 1, 9, 0 }, { 3, 4, 1 } };
+    SessionBuffer bufs[2] = {
+        { "/tmp/a.c", NULL, 12, 3, 5, 0, SESSION_LINE_NUMBERS, 7, 0, folds, 2 },
+        { NULL, "/tmp/s.loki.1", 0, 1, 0, 0, SESSION_MODIFIED, 0,
+          UINT64_C(0x1234567890abcdef), NULL, 0 },
+    };
+    SessionState st = { bufs, 2, 1 };
+    char *data;
+    size_t len;
+    ASSERT_EQ(session_serialize(&st, &data, &len), 0);
+
+    SessionState got;
+    ASSERT_EQ(session_deserialize(&got, data, len), 0);
+    ASSERT_EQ(got.count, 2);
+    ASSERT_EQ(got.current, 1);
+    ASSERT_STR_EQ(got.buf[0].path, "/tmp/a.c");
+    ASSERT_TRUE(got.buf[0].snapshot == NULL);
+    ASSERT_EQ(got.buf[0].row, 12);
+    ASSERT_EQ(got.buf[0].col, 3);
+    ASSERT_EQ(got.buf[0].rowoff, 5);
+    ASSERT_EQ(got.buf[0].flags, SESSION_LINE_NUMBERS);
+    ASSERT_EQ(got.buf[0].undo_seq, 7);
+    ASSERT_EQ(got.buf[0].nfolds, 2);
+    ASSERT_EQ(got.buf[0].folds[1].first, 3);
+    ASSERT_EQ(got.buf[0].folds[1].closed, 1);
+    ASSERT_TRUE(got.buf[1].path == NULL);
+    ASSERT_STR_EQ(got.buf[1].snapshot, "/tmp/s.loki.1");
+    ASSERT_TRUE(got.buf[1].text_hash == UINT64_C(0x1234567890abcdef));
+    session_state_free(&got);
+
+    /* Cut short anywhere: refused */
+    for (size_t n = 0; n < len; n++)
+        ASSERT_EQ(session_deserialize(&got, data, n), -1);
+    free(data);
+}
+
+TEST(session_restores_buffers) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    int scratch = buffer_get_current_id();
+
+    int a = buffer_create(write_file("a.txt", "0\n1\n2\n3\n4\n5\n6\nseven\n8\n9\n"));
+    int b = buffer_create(write_file("b.txt", "beta\n"));
+    ASSERT_EQ(buffer_switch(a), 0);
+    ASSERT_EQ(buffer_close(scratch, 0), 0);
+    editor_ctx_t *c = buffer_get_current();
+    editor_fold_add(&c->model, 2, 4, 1);
+    editor_cursor_to(c, 7, 3);
+    ASSERT_EQ(buffer_switch(b), 0);
+    buffer_get_current()->view.line_numbers = 1;
+    ASSERT_EQ(session_file_save(SESSION), 2);
+    ASSERT_TRUE(session_file_is_session(SESSION));
+    ASSERT_FALSE(session_file_is_session(TEST_DIR "/a.txt"));
+    buffers_free();
+
+    /* Opened after the empty buffer, which goes; only b.txt is read */
+    init_test_context(&ctx);
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    int missing;
+    ASSERT_EQ(session_file_load(SESSION, &missing), 2);
+    ASSERT_EQ(missing, 0);
+    ASSERT_EQ(buffer_count(), 2);
+    c = buffer_get_current();
+    ASSERT_STR_EQ(c->model.row[0].chars, "beta");
+    ASSERT_EQ(c->view.line_numbers, 1);
+    int ids[2];
+    ASSERT_EQ(buffer_get_list(ids, 2), 2);
+    ASSERT_EQ(buffer_get_state(ids[0]), BUFFER_UNREAD);
+
+    /* Its view and folds when shown */
+    ASSERT_EQ(buffer_switch(ids[0]), 0);
+    c = buffer_get_current();
+    ASSERT_EQ(c->view.rowoff + c->view.cy, 7);
+    ASSERT_EQ(c->view.coloff + c->view.cx, 3);
+    ASSERT_EQ(c->view.line_numbers, 0);
+    ASSERT_EQ(fold_count(c->model.folds), 1);
+    int first, last, closed;
+    ASSERT_EQ(fold_get(c->model.folds, 0, &first, &last, &closed), 0);
+    ASSERT_EQ(first, 2);
+    ASSERT_EQ(last, 4);
+    ASSERT_EQ(closed, 1);
+    ASSERT_EQ(c->model.dirty, 0);
+
+    /* A file gone is counted, not opened */
+    unlink(TEST_DIR "/b.txt");
+    buffers_free();
+    init_test_context(&ctx);
+    buffers_init(&ctx);
+    ASSERT_EQ(session_file_load(SESSION, &missing), 1);
+    ASSERT_EQ(missing, 1);
+    ASSERT_EQ(session_file_load(TEST_DIR "/a.txt", &missing), -1);
+    buffers_free();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+TEST(session_restores_unsaved_changes) {
+    editor_ctx_t ctx;
+    init_test_context(&ctx);
+    undo_journal_set_dir(TEST_DIR "/undo");
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    editor_ctx_t *c = buffer_get_current();
+    editor_insert_text(c, "scratch", 7);
+    int a = buffer_create(write_file("a.txt", "one\ntwo\n"));
+    ASSERT_EQ(buffer_switch(a), 0);
+    c = buffer_get_current();
+    editor_row_set(c, &c->model.row[1], "TWO!", 4);
+    ASSERT_EQ(session_file_save(SESSION), 2);
+    ASSERT_EQ(access(SESSION ".0", F_OK), 0);
+    ASSERT_EQ(access(SESSION ".1", F_OK), 0);
+    buffers_free();
+
+    init_test_context(&ctx);
+    ASSERT_EQ(buffers_init(&ctx), 0);
+    ASSERT_EQ(session_file_load(SESSION, NULL), 2);
+    c = buffer_get_current();
+    ASSERT_STR_EQ(c->model.filename, TEST_DIR "/a.txt");
+    ASSERT_EQ(c->model.numrows, 2);
+    ASSERT_STR_EQ(c->model.row[1].chars, "TWO!");
+    ASSERT_TRUE(c->model.dirty != 0);
+    int ids[2];
+    buffer_get_list(ids, 2);
+    ASSERT_EQ(buffer_switch(ids[0]), 0);
+    c = buffer_get_current();
+    ASSERT_TRUE(c->model.filename == NULL);
+    ASSERT_STR_EQ(c->model.row[0].chars, "scratch");
+
+    /* Not needed once the buffers hold nothing unsaved */
+    ASSERT_EQ(buffer_close(ids[0], 1), 0);
+    buffer_switch(ids[1]);
+    c = buffer_get_current();
+    editor_row_set(c, &c->model.row[1], "two", 3);
+    c->model.dirty = 0;
+    ASSERT_EQ(session_file_save(SESSION), 1);
+    ASSERT_EQ(access(SESSION ".0", F_OK), -1);
+    ASSERT_EQ(access(SESSION ".1", F_OK), -1);
+    buffers_free();
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+BEGIN_TEST_SUITE("Sessions")
+    RUN_TEST(session_format_round_trip);
+    RUN_TEST(session_restores_buffers);
+    RUN_TEST(session_restores_unsaved_changes);
+END_TEST_SUITE()
@@ -0,0 +1,125 @@
+/* test_sort.c - Unit tests for sorting lines
+ *
+ * Tests for:
+ * - Flags, and rows sorted by text, undone in one step
+ * - By number, in reverse, and with repeats left out
+ * - :[range]sort leaving the rows around the range alone
+ * - Ranges sorted on the pool matching the order of one thread, ties kept
+ */
+
+#include "test_framework.h"
+#include "sort.h"
+#include "command.h"
+#include "internal.h"
+#include "undo.h"
+#include <stdio.h>
+#include <string.h>
+
+static void fill(editor_ctx_t *ctx, const char **lines, int n) {
+    editor_ctx_init(ctx);
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+TEST(sort_orders_text) {
+    int column;
+    ASSERT_EQ(sort_parse_flags("", &column), 0);
+    ASSERT_EQ(column, -1);
+    ASSERT_EQ(sort_parse_flags("n u", &column), SORT_NUMERIC | SORT_UNIQUE);
+    ASSERT_EQ(sort_parse_flags("ru 3", &column), SORT_REVERSE | SORT_UNIQUE);
+    ASSERT_EQ(column, 2);
+    ASSERT_EQ(sort_parse_flags("x", &column), -1);
+    ASSERT_EQ(sort_parse_flags("0", &column), -1);
+
+    const char *lines[] = { "cherry", "apple", "banana", "apple pie", "" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 5);
+    undo_break_group(&ctx);
+    ASSERT_EQ(sort_lines(&ctx, 0, 4, 0, -1), 5);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "apple");
+    ASSERT_STR_EQ(ctx.model.row[2].chars, "apple pie");
+    ASSERT_STR_EQ(ctx.model.row[3].chars, "banana");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "cherry");
+    ASSERT_EQ(ctx.model.row[4].size, 6);
+
+    /* One step back */
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 5);
+    for (int i = 0; i < 5; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, lines[i]);
+    editor_ctx_free(&ctx);
+}
+
+TEST(sort_by_number_reversed_unique) {
+    const char *lines[] = { "x10", "a2", "none", "b-3", "c2", "also none" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 6);
+    ASSERT_EQ(sort_lines(&ctx, 0, 5, SORT_NUMERIC, -1), 6);
+    const char *numeric[] = { "none", "also none", "b-3", "a2", "c2", "x10" };
+    for (int i = 0; i < 6; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, numeric[i]);
+
+    /* Equal numbers are repeats, the first kept */
+    ASSERT_EQ(sort_lines(&ctx, 0, 5, SORT_NUMERIC | SORT_REVERSE | SORT_UNIQUE, -1), 4);
+    ASSERT_EQ(ctx.model.numrows, 4);
+    const char *unique[] = { "x10", "a2", "b-3", "none" };
+    for (int i = 0; i < 4; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, unique[i]);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 6);
+    ASSERT_STR_EQ(ctx.model.row[5].chars, "x10");
+    editor_ctx_free(&ctx);
+}
+
+TEST(sort_command_range) {
+    const char *lines[] = { "z", "c", "b", "b", "a", "y" };
+    editor_ctx_t ctx;
+    fill(&ctx, lines, 6);
+    ASSERT_TRUE(command_execute(&ctx, ":2,5sort u"));
+    ASSERT_EQ(ctx.model.numrows, 5);
+    const char *sorted[] = { "z", "a", "b", "c", "y" };
+    for (int i = 0; i < 5; i++) ASSERT_STR_EQ(ctx.model.row[i].chars, sorted[i]);
+
+    ASSERT_FALSE(command_execute(&ctx, ":sort q"));
+    ASSERT_TRUE(command_execute(&ctx, ":sort r"));
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "z");
+    ASSERT_STR_EQ(ctx.model.row[4].chars, "a");
+    editor_ctx_free(&ctx);
+}
+
+TEST(sort_many_rows_in_parallel) {
+    int n = SORT_PARALLEL_MIN * 3 + 7;
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    char line[32];
+    unsigned seed = 1;
+    for (int i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        /* Few distinct numbers, so ties are many */
+        int len = snprintf(line, sizeof(line), "%u row %d", (seed >> 16) % 1000, i);
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+    ASSERT_EQ(sort_lines(&ctx, 0, n - 1, SORT_NUMERIC, -1), n);
+    ASSERT_EQ(ctx.model.numrows, n);
+
+    /* By number, and rows of one number in the order they came */
+    int ordered = 1;
+    for (int i = 1; i < n && ordered; i++) {
+        int a, b, ra, rb;
+        sscanf(ctx.model.row[i - 1].chars, "%d row %d", &a, &ra);
+        sscanf(ctx.model.row[i].chars, "%d row %d", &b, &rb);
+        ordered = a < b || (a == b && ra < rb);
+    }
+    ASSERT_TRUE(ordered);
+
+    ASSERT_EQ(sort_lines(&ctx, 0, n - 1, SORT_NUMERIC | SORT_UNIQUE, -1), 1000);
+    ASSERT_EQ(ctx.model.numrows, 1000);
+    ASSERT_EQ(strncmp(ctx.model.row[999].chars, "999 row ", 8), 0);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Sort")
+    RUN_TEST(sort_orders_text);
+    RUN_TEST(sort_by_number_reversed_unique);
+    RUN_TEST(sort_command_range);
+    RUN_TEST(sort_many_rows_in_parallel);
+END_TEST_SUITE()
@@ -0,0 +1,217 @@
+/* test_spell.c - Unit tests for spell checking
+ *
+ * Tests for:
+ * - Words looked up in a mapped word list, in the cases it allows
+ * - Misspelt words of the rows shown decorated, and no other rows read
+ * - Rows checked again only once edited, not when shown again
+ * - Only comments and strings checked in code, and not code in Markdown
+ * - A word list that cannot be read
+ */
+
+#include "test_framework.h"
+#include "spell.h"
+#include "decor.h"
+#include "syntax.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_spell_test"
+
+static const char *write_dict(void) {
+    static char path[256];
+    mkdir(TEST_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/words", TEST_DIR);
+    FILE *f = fopen(path, "w");
+    fputs("hello\nworld\nParis\nthe\ncat\nsat\non\nmat\neditor\r\nis\nfine\n"
+          "comment\ntext\n", f);
+    fclose(f);
+    return path;
+}
+
+static void fill(editor_ctx_t *ctx, int n, const char **lines) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    for (int i = 0; i < n; i++) {
+        char line[256];         /* editor_insert_row() takes it mutable */
+        size_t len = strlen(lines[i]);
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+        memcpy(line, lines[i], len);
+        line[len] = '\0';
+        editor_insert_row(ctx, i, line, len);
+    }
+}
+
+static int ok(const char *word) {
+    return spell_word_ok(word, strlen(word));
+}
+
+typedef struct Marked {
+    char text[8][32];
+    int count;
+    const char *row;
+} Marked;
+
+static void got_decor(void *opaque, const Decor *d) {
+    Marked *m = opaque;
+    if (d->group != DECOR_GROUP_SPELL || m->count == 8) return;
+    snprintf(m->text[m->count++], 32, "%.*s", d->end - d->col, m->row + d->col);
+}
+
+static Marked marked(editor_ctx_t *ctx, int row) {
+    Marked m = {0};
+    m.row = ctx->model.row[row].chars;
+    if (ctx->model.decor) decor_row_each(ctx->model.decor, row, got_decor, &m);
+    return m;
+}
+
+TEST(spell_words_and_cases) {
+    spell_cleanup();
+    spell_set_file(write_dict());
+    ASSERT_TRUE(ok("hello"));
+    ASSERT_TRUE(ok("Hello"));
+    ASSERT_TRUE(ok("HELLO"));
+    ASSERT_FALSE(ok("hELLo"));
+    ASSERT_TRUE(ok("Paris"));
+    ASSERT_TRUE(ok("PARIS"));
+    ASSERT_FALSE(ok("paris"));
+    ASSERT_TRUE(ok("editor"));          /* Its line ends in CR LF */
+    ASSERT_TRUE(ok("editor's"));
+    ASSERT_FALSE(ok("helo"));
+    ASSERT_FALSE(ok("hell"));
+
+    SpellStats st;
+    spell_stats(&st);
+    ASSERT_EQ(st.dict_words, 13);
+    ASSERT_EQ(st.misspelt, 4);
+    ASSERT_TRUE(st.rejected > 0);
+    spell_cleanup();
+}
+
+TEST(spell_checks_rows_shown_once) {
+    spell_cleanup();
+    spell_set_file(write_dict());
+    const char *lines[40];
+    for (int i = 0; i < 40; i++) lines[i] = "the cat sat on teh mat";
+    lines[2] = "hello wrold foo_bar camelCase x2y file.txt";
+    editor_ctx_t ctx;
+    fill(&ctx, 40, lines);
+    ASSERT_EQ(spell_enable(&ctx), 0);
+
+    syntax_fresh_rows(&ctx, 0, 10);
+    SpellStats st;
+    spell_stats(&st);
+    ASSERT_EQ(st.rows, 10);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 10);
+    Marked m = marked(&ctx, 2);
+    ASSERT_EQ(m.count, 1);
+    ASSERT_STR_EQ(m.text[0], "wrold");
+    m = marked(&ctx, 0);
+    ASSERT_EQ(m.count, 1);
+    ASSERT_STR_EQ(m.text[0], "teh");
+    ASSERT_EQ(marked(&ctx, 20).count, 0);
+
+    /* Shown again, or scrolled back to: nothing checked again */
+    syntax_fresh_rows(&ctx, 0, 10);
+    syntax_fresh_rows(&ctx, 5, 15);
+    syntax_fresh_rows(&ctx, 0, 10);
+    spell_stats(&st);
+    ASSERT_EQ(st.rows, 15);
+
+    /* An edited row is checked again, as it is */
+    editor_row_set(&ctx, &ctx.model.row[2], "hello world", 11);
+    syntax_fresh_rows(&ctx, 0, 10);
+    spell_stats(&st);
+    ASSERT_EQ(st.rows, 16);
+    ASSERT_EQ(marked(&ctx, 2).count, 0);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 14);
+
+    /* A row inserted moves the decorations below it */
+    editor_insert_row(&ctx, 0, "fine", 4);
+    ASSERT_EQ(marked(&ctx, 1).count, 1);
+
+    spell_disable(&ctx);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 0);
+    syntax_fresh_rows(&ctx, 20, 30);
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 0);
+    editor_ctx_free(&ctx);
+    spell_cleanup();
+}
+
+TEST(spell_code_comments_only) {
+    spell_cleanup();
+    spell_set_file(write_dict());
+    const char *lines[] = {
+        "int wrold = 0; /* hello wrold */",
+        "char *s = \"teh text\";",
+        "\tfoo(); // the\tcomnent",
+    };
+    editor_ctx_t ctx;
+    fill(&ctx, 3, lines);
+    syntax_select_for_filename(&ctx, "test.c");
+    ASSERT_EQ(spell_enable(&ctx), 0);
+    syntax_fresh_rows(&ctx, 0, 3);
+
+    Marked m = marked(&ctx, 0);
+    ASSERT_EQ(m.count, 1);
+    ASSERT_STR_EQ(m.text[0], "wrold");
+    m = marked(&ctx, 1);
+    ASSERT_EQ(m.count, 1);
+    ASSERT_STR_EQ(m.text[0], "teh");
+    m = marked(&ctx, 2);                /* After TABs */
+    ASSERT_EQ(m.count, 1);
+    ASSERT_STR_EQ(m.text[0], "comnent");
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 3);
+    editor_ctx_free(&ctx);
+    spell_cleanup();
+}
+
+TEST(spell_markdown_skips_code) {
+    spell_cleanup();
+    spell_set_file(write_dict());
+    const char *lines[] = {
+        "# Helo world",
+        "the `wrold` is fine",
+        "```c",
+        "teh code",
+        "```",
+        "the mat is fien",
+    };
+    editor_ctx_t ctx;
+    fill(&ctx, 6, lines);
+    syntax_select_for_filename(&ctx, "notes.md");
+    ASSERT_EQ(spell_enable(&ctx), 0);
+    syntax_fresh_rows(&ctx, 0, 6);
+
+    ASSERT_STR_EQ(marked(&ctx, 0).text[0], "Helo");
+    ASSERT_EQ(marked(&ctx, 1).count, 0);
+    ASSERT_EQ(marked(&ctx, 3).count, 0);
+    ASSERT_STR_EQ(marked(&ctx, 5).text[0], "fien");
+    ASSERT_EQ(decor_count(ctx.model.decor, DECOR_GROUP_SPELL), 2);
+    editor_ctx_free(&ctx);
+    spell_cleanup();
+}
+
+TEST(spell_missing_word_list) {
+    spell_cleanup();
+    spell_set_file(TEST_DIR "/none");
+    editor_ctx_t ctx;
+    fill(&ctx, 1, (const char *[]){ "teh" });
+    ASSERT_EQ(spell_enable(&ctx), -1);
+    ASSERT_FALSE(ctx.model.spell);
+    ASSERT_TRUE(strstr(ctx.view.statusmsg, "none") != NULL);
+    ASSERT_FALSE(ok("teh"));
+    editor_ctx_free(&ctx);
+    spell_cleanup();
+}
+
+BEGIN_TEST_SUITE("Spell")
+    RUN_TEST(spell_words_and_cases);
+    RUN_TEST(spell_checks_rows_shown_once);
+    RUN_TEST(spell_code_comments_only);
+    RUN_TEST(spell_markdown_skips_code);
+    RUN_TEST(spell_missing_word_list);
+END_TEST_SUITE()
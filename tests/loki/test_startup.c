@@ -0,0 +1,66 @@
+/* test_startup.c - Unit tests for the startup phase timings
+ *
+ * Tests for:
+ * - Phases timed from mark to mark, and nothing recorded after the end
+ * - Initializations deferred to first use, and the report listing those
+ *   that ran during startup
+ */
+
+#include "test_framework.h"
+#include "startup.h"
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+TEST(phases_are_timed_from_mark_to_mark) {
+    ASSERT_FALSE(startup_active());
+    startup_mark("before");                 /* Not begun: ignored */
+    ASSERT_EQ(startup_phase_count(), 0);
+
+    startup_begin();
+    ASSERT_TRUE(startup_active());
+    startup_mark("first");
+    uv_sleep(2);
+    startup_mark("second");
+    ASSERT_EQ(startup_phase_count(), 2);
+    ASSERT_STR_EQ(startup_phase(0)->name, "first");
+    ASSERT_STR_EQ(startup_phase(1)->name, "second");
+    ASSERT_TRUE(startup_phase(1)->ns >= 2000000);
+    ASSERT_EQ(startup_total_ns(), startup_phase(0)->ns + startup_phase(1)->ns);
+    ASSERT_NULL(startup_phase(2));
+
+    startup_end();
+    ASSERT_FALSE(startup_active());
+    startup_mark("after");
+    ASSERT_EQ(startup_phase_count(), 2);
+}
+
+TEST(deferred_initializations_are_reported_during_startup_only) {
+    startup_begin();
+    startup_note_deferred("early", uv_hrtime());
+    startup_mark("phase");
+    startup_end();
+    uv_sleep(1);
+    startup_note_deferred("late", uv_hrtime());
+    ASSERT_EQ(startup_deferred_count(), 2);
+    ASSERT_STR_EQ(startup_deferred(1)->name, "late");
+    ASSERT_TRUE(startup_deferred(1)->at_ns > startup_total_ns());
+
+    /* The report lists the phases, and what ran within them */
+    FILE *fp = tmpfile();
+    ASSERT_NOT_NULL(fp);
+    startup_print(fp);
+    char out[512];
+    rewind(fp);
+    size_t n = fread(out, 1, sizeof(out) - 1, fp);
+    out[n] = '\0';
+    fclose(fp);
+    ASSERT_TRUE(strstr(out, "phase") != NULL);
+    ASSERT_TRUE(strstr(out, "early") != NULL);
+    ASSERT_TRUE(strstr(out, "late") == NULL);
+}
+
+BEGIN_TEST_SUITE("Startup Timings")
+    RUN_TEST(phases_are_timed_from_mark_to_mark);
+    RUN_TEST(deferred_initializations_are_reported_during_startup_only);
+END_TEST_SUITE()
@@ -0,0 +1,311 @@
+/* test_symbols.c - Unit tests for the project symbol index
+ *
+ * Tests for:
+ * - Building the index by walking a tree, skipping ignored files
+ * - Exact and prefix lookups, in name order
+ * - Reopening a written index without walking again
+ * - Saved files, and files found changed by a lookup, indexed again
+ * - Refreshing after files are added and deleted, and a bad index file
+ * - Jobs on the task pool, taken in as their events are dispatched
+ */
+
+#define _DEFAULT_SOURCE     /* nanosleep() */
+
+#include "test_framework.h"
+#include "symbols.h"
+#include "async_queue.h"
+#include "task_pool.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_symbols_test"
+
+static void write_file(const char *rel, const char *content) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return;
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void make_dir(const char *rel) {
+    char path[512];
+    snprintf(path, sizeof(path), TEST_DIR "/%s", rel);
+    mkdir(path, 0755);
+}
+
+static void setup_tree(void) {
+    symbols_close();
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    make_dir("src");
+    make_dir("lib");
+    make_dir("build");
+    make_dir(".git");
+    write_file("src/shapes.py",
+               "class Shape:\n    def area(self):\n        return 0\n\n"
+               "def make_shape():\n    return Shape()\n");
+    write_file("lib/util.lua",
+               "local M = {}\nfunction M.open(path) end\n"
+               "local function helper() end\nreturn M\n");
+    write_file("README.md", "# Intro\ntext\n## Usage\nmore\n");
+    write_file("notes.txt", "def not_indexed():\n");
+    write_file("build/gen.py", "def generated():\n    pass\n");
+    write_file(".git/hook.py", "def hook():\n    pass\n");
+    write_file(".gitignore", "build/\n");
+}
+
+static void cleanup_tree(void) {
+    symbols_close();
+    system("rm -rf " TEST_DIR);
+}
+
+/* The one symbol named 'name', or a zeroed one */
+static Symbol find_one(const char *name) {
+    Symbol s[4];
+    memset(s, 0, sizeof(s));
+    if (symbols_find(name, 0, s, 4) != 1) memset(&s[0], 0, sizeof(s[0]));
+    return s[0];
+}
+
+static int path_is(const Symbol *s, const char *path) {
+    return s->path && (size_t)s->path_len == strlen(path) &&
+           memcmp(s->path, path, strlen(path)) == 0;
+}
+
+TEST(symbols_walk_builds_the_index) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+
+    Symbol s = find_one("area");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+    ASSERT_EQ(s.line, 2);
+    ASSERT_STR_EQ(symbols_kind_name(s.kind), "function");
+    s = find_one("Shape");
+    ASSERT_STR_EQ(symbols_kind_name(s.kind), "type");
+    s = find_one("open");
+    ASSERT_TRUE(path_is(&s, "lib/util.lua"));
+    s = find_one("Usage");
+    ASSERT_EQ(s.line, 3);
+    ASSERT_STR_EQ(symbols_kind_name(s.kind), "heading");
+
+    /* Ignored, hidden by version control, or without tags */
+    Symbol none[4];
+    ASSERT_EQ(symbols_find("generated", 0, none, 4), 0);
+    ASSERT_EQ(symbols_find("hook", 0, none, 4), 0);
+    ASSERT_EQ(symbols_find("not_indexed", 0, none, 4), 0);
+
+    struct stat st;
+    ASSERT_EQ(stat(TEST_DIR "/.loki/index", &st), 0);
+    long files, syms;
+    symbols_counts(&files, &syms);
+    ASSERT_EQ(files, 3);
+    ASSERT_EQ(syms, 7);
+    cleanup_tree();
+}
+
+TEST(symbols_prefix_lookups_come_in_name_order) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+
+    Symbol s[16];
+    int n = symbols_find("", SYMBOLS_PREFIX, s, 16);
+    ASSERT_EQ(n, 7);
+    for (int i = 1; i < n; i++) {
+        size_t len = (size_t)(s[i].name_len < s[i - 1].name_len
+                              ? s[i].name_len : s[i - 1].name_len);
+        int c = memcmp(s[i - 1].name, s[i].name, len);
+        ASSERT_TRUE(c < 0 || (c == 0 && s[i - 1].name_len <= s[i].name_len));
+    }
+    n = symbols_find("ma", SYMBOLS_PREFIX, s, 16);
+    ASSERT_EQ(n, 1);
+    ASSERT_EQ(s[0].name_len, 10);   /* make_shape */
+    ASSERT_EQ(symbols_find("", SYMBOLS_PREFIX, s, 3), 3);
+    ASSERT_EQ(symbols_find("ma", 0, s, 16), 0);
+    cleanup_tree();
+}
+
+TEST(symbols_reopen_maps_the_index_without_walking) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+    symbols_close();
+
+    /* Files added since are not seen until something says so */
+    write_file("src/later.py", "def later():\n    pass\n");
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    ASSERT_FALSE(symbols_busy());
+    Symbol s = find_one("make_shape");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+    ASSERT_EQ(s.line, 5);
+    Symbol none[4];
+    ASSERT_EQ(symbols_find("later", 0, none, 4), 0);
+    symbols_wait();
+    ASSERT_EQ(symbols_find("later", 0, none, 4), 0);
+    cleanup_tree();
+}
+
+TEST(symbols_saved_file_is_indexed_again) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+
+    write_file("src/shapes.py", "def make_circle():\n    pass\n");
+    symbols_note_file(TEST_DIR "/src/shapes.py");
+    symbols_wait();
+    Symbol none[4];
+    ASSERT_EQ(symbols_find("make_shape", 0, none, 4), 0);
+    ASSERT_EQ(symbols_find("area", 0, none, 4), 0);
+    Symbol s = find_one("make_circle");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+    ASSERT_EQ(s.line, 1);
+
+    /* Kept in memory until closing writes it out */
+    symbols_close();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    s = find_one("make_circle");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+    ASSERT_EQ(symbols_find("make_shape", 0, none, 4), 0);
+
+    /* A file deleted is dropped */
+    unlink(TEST_DIR "/lib/util.lua");
+    symbols_note_file(TEST_DIR "/lib/util.lua");
+    symbols_wait();
+    ASSERT_EQ(symbols_find("open", 0, none, 4), 0);
+    cleanup_tree();
+}
+
+TEST(symbols_lookup_notices_a_changed_file) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+
+    write_file("lib/util.lua", "local M = {}\n\n\nfunction M.open(path) end\n");
+    /* Answered from the index, and the file marked */
+    Symbol s = find_one("open");
+    ASSERT_EQ(s.line, 2);
+    symbols_wait();
+    s = find_one("open");
+    ASSERT_EQ(s.line, 4);
+    Symbol none[4];
+    ASSERT_EQ(symbols_find("helper", 0, none, 4), 0);
+    cleanup_tree();
+}
+
+TEST(symbols_refresh_walks_for_added_and_deleted_files) {
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+
+    write_file("src/later.py", "def later():\n    pass\n");
+    unlink(TEST_DIR "/README.md");
+    write_file("src/shapes.py", "def make_circle():\n    pass\n");
+    ASSERT_EQ(symbols_refresh(), 0);
+    symbols_wait();
+    Symbol none[4];
+    Symbol s = find_one("later");
+    ASSERT_TRUE(path_is(&s, "src/later.py"));
+    ASSERT_EQ(symbols_find("Usage", 0, none, 4), 0);
+    ASSERT_EQ(symbols_find("area", 0, none, 4), 0);
+    s = find_one("make_circle");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+    s = find_one("open");
+    ASSERT_TRUE(path_is(&s, "lib/util.lua"));
+    cleanup_tree();
+}
+
+TEST(symbols_bad_index_file_is_built_again) {
+    setup_tree();
+    make_dir(".loki");
+    write_file(".loki/index", "LOKISYM1 but not really an index");
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    symbols_wait();
+    Symbol s = find_one("area");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+
+    ASSERT_EQ(symbols_open(TEST_DIR "/missing"), -1);
+    cleanup_tree();
+    Symbol none[4];
+    ASSERT_EQ(symbols_find("area", 0, none, 4), -1);
+    ASSERT_EQ(symbols_refresh(), -1);
+}
+
+TEST(symbols_jobs_report_through_the_event_queue) {
+    ASSERT_EQ(async_queue_init(), 0);
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    ASSERT_EQ(symbols_tick(uv_hrtime()), -1);
+    ASSERT_TRUE(symbols_busy());
+    uint64_t give_up = uv_hrtime() + 10ULL * 1000000000ULL;
+    while (symbols_busy() && uv_hrtime() < give_up)
+        async_queue_dispatch(NULL, NULL, 1000000);
+    ASSERT_FALSE(symbols_busy());
+    Symbol s = find_one("area");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+
+    /* Marked files wait to settle, then go to the pool */
+    write_file("src/shapes.py", "def make_circle():\n    pass\n");
+    symbols_note_file(TEST_DIR "/src/shapes.py");
+    int due = symbols_tick(uv_hrtime());
+    ASSERT_TRUE(due > 0 && due <= SYMBOLS_SETTLE_MS);
+    ASSERT_EQ(symbols_tick(uv_hrtime() + (uint64_t)SYMBOLS_SETTLE_MS * 1000000), -1);
+    ASSERT_TRUE(symbols_busy());
+    symbols_wait();
+    s = find_one("make_circle");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+
+    cleanup_tree();
+    task_pool_shutdown();
+    async_queue_cleanup();
+}
+
+/* Waiting for a job whose completion finds the event queue full */
+TEST(symbols_wait_with_queue_full) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init_sized(4), 0);
+    /* Fill the lane jobs report on; events of no job are ignored */
+    async_queue_set_handler_lane(NULL, SYMBOLS_ASYNC_EVENT, NULL, ASYNC_LANE_LOW);
+    AsyncEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SYMBOLS_ASYNC_EVENT;
+    while (async_queue_push(NULL, &ev) == 0) {}
+
+    setup_tree();
+    ASSERT_EQ(symbols_open(TEST_DIR), 0);
+    ASSERT_EQ(symbols_tick(uv_hrtime()), -1);
+    ASSERT_TRUE(symbols_busy());
+    /* The worker is done, and waiting for room for its completion */
+    struct timespec ts = {0, 20000000};
+    nanosleep(&ts, NULL);
+    symbols_wait();
+    ASSERT_FALSE(symbols_busy());
+    Symbol s = find_one("area");
+    ASSERT_TRUE(path_is(&s, "src/shapes.py"));
+
+    cleanup_tree();
+    task_pool_shutdown();
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("Symbol Index")
+    /* Building and looking up */
+    RUN_TEST(symbols_walk_builds_the_index);
+    RUN_TEST(symbols_prefix_lookups_come_in_name_order);
+    RUN_TEST(symbols_reopen_maps_the_index_without_walking);
+
+    /* Keeping up with changes */
+    RUN_TEST(symbols_saved_file_is_indexed_again);
+    RUN_TEST(symbols_lookup_notices_a_changed_file);
+    RUN_TEST(symbols_refresh_walks_for_added_and_deleted_files);
+    RUN_TEST(symbols_bad_index_file_is_built_again);
+    RUN_TEST(symbols_jobs_report_through_the_event_queue);
+    RUN_TEST(symbols_wait_with_queue_full);
+END_TEST_SUITE()
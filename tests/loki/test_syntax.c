@@ -5,7 +5,7 @@
  * - String highlighting (quotes, escapes)
  * - Comment highlighting (single-line and multi-line)
  * - Number literal detection
- * - Multi-line comment state tracking
+ * - Multi-line comment state tracking, and catching up on it in idle time
  * - Language-specific highlighting
  */
 
@@ -13,6 +13,15 @@
 #include "loki/core.h"
 #include "internal.h"
 #include "syntax.h"
+#include "languages.h"
+#include "lang_bridge.h"
+#include "treesitter.h"
+#include "async_queue.h"
+#include "idle.h"
+#include "indent.h"
+#include "fold.h"
+#include <uv.h>
+#include <time.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -23,8 +32,7 @@ static void init_c_syntax_row(editor_ctx_t *ctx, t_erow *row, const char *text)
     row->size = strlen(text);
     row->render = strdup(text);
     row->rsize = strlen(text);
-    row->hl = calloc(row->rsize, 1);
-    row->idx = 0;
+    row->hl_buf.hl = calloc(row->rsize, 1);
 
     /* Set C syntax for context */
     extern struct t_editor_syntax HLDB[];
@@ -36,8 +44,8 @@ static void init_c_syntax_row(editor_ctx_t *ctx, t_erow *row, const char *text)
 /* Helper: Free row resources */
 static void free_row(t_erow *row) {
     free(row->chars);
-    free(row->render);
-    free(row->hl);
+    if (row->render != row->chars) free(row->render);
+    free(row->hl_buf.hl);
 }
 
 /* ============================================================================
@@ -52,10 +60,10 @@ TEST(syntax_c_keyword1_if) {
     init_c_syntax_row(&ctx, &row, "if (x)");
 
     /* "if" should be highlighted as KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
     /* Space after keyword should be NORMAL */
-    ASSERT_EQ(row.hl[2], HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_NORMAL);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -69,12 +77,12 @@ TEST(syntax_c_keyword1_return) {
     init_c_syntax_row(&ctx, &row, "return 0;");
 
     /* "return" should be highlighted as KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[2], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[3], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[4], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[5], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 3), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 4), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 5), HL_KEYWORD1);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -88,9 +96,9 @@ TEST(syntax_c_keyword2_int) {
     init_c_syntax_row(&ctx, &row, "int x;");
 
     /* "int" should be highlighted as KEYWORD2 (type) */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD2);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD2);
-    ASSERT_EQ(row.hl[2], HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_KEYWORD2);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -104,9 +112,9 @@ TEST(syntax_c_keyword_requires_separator) {
     /* "ifx" should NOT be highlighted (no separator after "if") */
     init_c_syntax_row(&ctx, &row, "ifx");
 
-    ASSERT_EQ(row.hl[0], HL_NORMAL);
-    ASSERT_EQ(row.hl[1], HL_NORMAL);
-    ASSERT_EQ(row.hl[2], HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_NORMAL);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -125,7 +133,7 @@ TEST(syntax_string_double_quotes) {
 
     /* Entire string including quotes should be HL_STRING */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_STRING);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_STRING);
     }
 
     free_row(&row);
@@ -140,9 +148,9 @@ TEST(syntax_string_single_quotes) {
     init_c_syntax_row(&ctx, &row, "'a'");
 
     /* Entire string including quotes should be HL_STRING */
-    ASSERT_EQ(row.hl[0], HL_STRING);
-    ASSERT_EQ(row.hl[1], HL_STRING);
-    ASSERT_EQ(row.hl[2], HL_STRING);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_STRING);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_STRING);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_STRING);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -157,7 +165,7 @@ TEST(syntax_string_escape_sequence) {
 
     /* Escape sequence should also be HL_STRING */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_STRING);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_STRING);
     }
 
     free_row(&row);
@@ -173,7 +181,7 @@ TEST(syntax_string_unterminated) {
 
     /* Unterminated string should still be highlighted */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_STRING);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_STRING);
     }
 
     free_row(&row);
@@ -193,7 +201,7 @@ TEST(syntax_c_single_line_comment) {
 
     /* Entire line should be HL_COMMENT */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_COMMENT);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_COMMENT);
     }
 
     free_row(&row);
@@ -208,13 +216,13 @@ TEST(syntax_c_single_line_comment_after_code) {
     init_c_syntax_row(&ctx, &row, "int x; // comment");
 
     /* "int" should be keyword */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD2);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD2);
-    ASSERT_EQ(row.hl[2], HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD2);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_KEYWORD2);
 
     /* Comment part should be HL_COMMENT */
-    ASSERT_EQ(row.hl[7], HL_COMMENT);  /* First / */
-    ASSERT_EQ(row.hl[8], HL_COMMENT);  /* Second / */
+    ASSERT_EQ(editor_row_hl_at(&row, 7), HL_COMMENT);  /* First / */
+    ASSERT_EQ(editor_row_hl_at(&row, 8), HL_COMMENT);  /* Second / */
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -229,7 +237,7 @@ TEST(syntax_c_multiline_comment_start) {
 
     /* Multi-line comment should be HL_MLCOMMENT */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_MLCOMMENT);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_MLCOMMENT);
     }
 
     /* Row should have open comment flag */
@@ -248,7 +256,7 @@ TEST(syntax_c_multiline_comment_complete) {
 
     /* Complete multi-line comment should be HL_MLCOMMENT */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_MLCOMMENT);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_MLCOMMENT);
     }
 
     /* Row should NOT have open comment flag (it's closed) */
@@ -272,16 +280,14 @@ TEST(syntax_c_multiline_comment_continuation) {
     ctx.model.row[0].size = strlen(ctx.model.row[0].chars);
     ctx.model.row[0].render = strdup(ctx.model.row[0].chars);
     ctx.model.row[0].rsize = ctx.model.row[0].size;
-    ctx.model.row[0].hl = calloc(ctx.model.row[0].rsize, 1);
-    ctx.model.row[0].idx = 0;
+    ctx.model.row[0].hl_buf.hl = calloc(ctx.model.row[0].rsize, 1);
 
     /* Second line: continuation */
     ctx.model.row[1].chars = strdup("still comment */");
     ctx.model.row[1].size = strlen(ctx.model.row[1].chars);
     ctx.model.row[1].render = strdup(ctx.model.row[1].chars);
     ctx.model.row[1].rsize = ctx.model.row[1].size;
-    ctx.model.row[1].hl = calloc(ctx.model.row[1].rsize, 1);
-    ctx.model.row[1].idx = 1;
+    ctx.model.row[1].hl_buf.hl = calloc(ctx.model.row[1].rsize, 1);
 
     extern struct t_editor_syntax HLDB[];
     ctx.view.syntax = &HLDB[0];  /* C syntax */
@@ -295,7 +301,7 @@ TEST(syntax_c_multiline_comment_continuation) {
 
     /* Second row should continue comment */
     for (int i = 0; i < ctx.model.row[1].rsize; i++) {
-        ASSERT_EQ(ctx.model.row[1].hl[i], HL_MLCOMMENT);
+        ASSERT_EQ(editor_row_hl_at(&ctx.model.row[1], i), HL_MLCOMMENT);
     }
 
     /* Second row should NOT have open comment (it's closed) */
@@ -304,8 +310,8 @@ TEST(syntax_c_multiline_comment_continuation) {
     /* Free manually created buffer */
     for (int i = 0; i < ctx.model.numrows; i++) {
         free(ctx.model.row[i].chars);
-        free(ctx.model.row[i].render);
-        free(ctx.model.row[i].hl);
+        if (ctx.model.row[i].render != ctx.model.row[i].chars) free(ctx.model.row[i].render);
+        free(ctx.model.row[i].hl_buf.hl);
     }
     free(ctx.model.row);
     ctx.model.row = NULL;
@@ -314,6 +320,139 @@ TEST(syntax_c_multiline_comment_continuation) {
     editor_ctx_free(&ctx);
 }
 
+TEST(syntax_far_jump_is_bounded_per_frame) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    int n = 300000;
+    editor_insert_row(&ctx, 0, "/* opened at the top", 20);
+    for (int i = 1; i < n; i++) editor_insert_row(&ctx, i, "int x;", 6);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+
+    /* Far more rows above the viewport than one frame's budget covers */
+    syntax_fresh_rows(&ctx, n - 10, n);
+    ASSERT_TRUE(syntax_pending(&ctx));
+    ASSERT_TRUE(ctx.model.hl_stale_from < n - 10);
+    for (int r = n - 10; r < n; r++) ASSERT_FALSE(ctx.model.row[r].hl_stale);
+    /* Shown before the comment above is known */
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[n-1], 0), HL_KEYWORD2);
+
+    /* Later frames resume from the checkpoint and correct the rows */
+    int frames = 0;
+    while (syntax_pending(&ctx) && frames < n) {
+        int from = ctx.model.hl_stale_from;
+        syntax_fresh_rows(&ctx, n - 10, n);
+        ASSERT_TRUE(ctx.model.hl_stale_from > from);
+        frames++;
+    }
+    ASSERT_FALSE(syntax_pending(&ctx));
+    for (int r = n - 10; r < n; r++)
+        ASSERT_EQ(editor_row_hl_at(&ctx.model.row[r], 0), HL_MLCOMMENT);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(syntax_far_jump_catches_up_in_idle_time) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    int n = 300000;
+    editor_insert_row(&ctx, 0, "/* opened at the top", 20);
+    for (int i = 1; i < n; i++) editor_insert_row(&ctx, i, "int x;", 6);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+
+    syntax_fresh_rows(&ctx, n - 10, n);
+    ASSERT_TRUE(syntax_pending(&ctx));
+    ASSERT_EQ(idle_pending(), 1);
+
+    /* Passes of idle time finish it without another frame, and ask for
+     * one when done */
+    int passes = 0, damage = 0;
+    while (idle_pending() && passes < n) {
+        uint64_t start = uv_hrtime();
+        damage = idle_run(1000000);
+        /* One checkpoint of rows past the budget at most */
+        ASSERT_TRUE(uv_hrtime() - start < 50000000);
+        passes++;
+    }
+    ASSERT_TRUE(passes > 1);
+    ASSERT_TRUE(damage);
+    ASSERT_TRUE(ctx.model.hl_stale_from >= n - 1);
+    syntax_fresh_rows(&ctx, n - 10, n);
+    ASSERT_FALSE(syntax_pending(&ctx));
+    for (int r = n - 10; r < n; r++)
+        ASSERT_EQ(editor_row_hl_at(&ctx.model.row[r], 0), HL_MLCOMMENT);
+
+    /* A buffer freed takes its idle task with it */
+    editor_insert_row(&ctx, 1, "*/", 2);  /* All rows below change */
+    syntax_fresh_rows(&ctx, n - 10, n);
+    ASSERT_EQ(idle_pending(), 1);
+    editor_ctx_free(&ctx);
+    ASSERT_EQ(idle_pending(), 0);
+}
+
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
+void editor_del_row(editor_ctx_t *ctx, int at);
+
+TEST(syntax_update_row_marks_rows_below_for_catch_up) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < 10; i++) editor_insert_row(&ctx, i, "int x;", 6);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+    syntax_fresh_rows(&ctx, 0, 10);
+    ASSERT_TRUE(ctx.model.hl_stale_from >= 10);
+
+    /* A row above the stale ones opens a comment when redone: those
+     * below it are caught up again */
+    t_erow *row = &ctx.model.row[2];
+    memcpy(row->chars, "/*", 2);     /* Rendered as it is */
+    syntax_update_row(&ctx, row);
+    ASSERT_TRUE(ctx.model.hl_stale_from <= 3);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 8), 0), HL_MLCOMMENT);
+
+    editor_ctx_free(&ctx);
+}
+
+static int hook_calls, hook_rows;
+
+static void marking_hook(editor_ctx_t *ctx, int first, int last) {
+    hook_calls++;
+    hook_rows += last - first;
+    for (int r = first; r < last; r++) editor_row_hl(&ctx->model.row[r])[0] = HL_MATCH;
+}
+
+TEST(syntax_row_hook_batches_fresh_rows) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    for (int i = 0; i < 20; i++) editor_insert_row(&ctx, i, "int x;", 6);
+    extern struct t_editor_syntax HLDB[];
+    ctx.view.syntax = &HLDB[0];  /* C syntax */
+    hook_calls = hook_rows = 0;
+    syntax_set_row_hook(marking_hook);
+
+    /* One call for the drawn range, on top of the syntax rules */
+    syntax_fresh_rows(&ctx, 0, 10);
+    ASSERT_EQ(hook_calls, 1);
+    ASSERT_EQ(hook_rows, 10);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[3], 0), HL_MATCH);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[3], 1), HL_KEYWORD2);
+
+    /* Rows it has seen are not passed again */
+    syntax_fresh_rows(&ctx, 0, 10);
+    syntax_fresh_row(&ctx, 5);
+    ASSERT_EQ(hook_calls, 1);
+
+    /* An edited row is */
+    editor_row_insert_char(&ctx, &ctx.model.row[5], 6, ' ');
+    syntax_fresh_rows(&ctx, 0, 10);
+    ASSERT_EQ(hook_calls, 2);
+    ASSERT_EQ(hook_rows, 11);
+
+    syntax_set_row_hook(NULL);
+    editor_ctx_free(&ctx);
+}
+
 /* ============================================================================
  * Number Highlighting Tests
  * ============================================================================ */
@@ -326,9 +465,9 @@ TEST(syntax_number_integer) {
     init_c_syntax_row(&ctx, &row, "123");
 
     /* All digits should be HL_NUMBER */
-    ASSERT_EQ(row.hl[0], HL_NUMBER);
-    ASSERT_EQ(row.hl[1], HL_NUMBER);
-    ASSERT_EQ(row.hl[2], HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_NUMBER);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -343,7 +482,7 @@ TEST(syntax_number_decimal) {
 
     /* All digits and decimal point should be HL_NUMBER */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_NUMBER);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_NUMBER);
     }
 
     free_row(&row);
@@ -358,8 +497,8 @@ TEST(syntax_number_after_separator) {
     init_c_syntax_row(&ctx, &row, "x=42");
 
     /* 42 should be highlighted */
-    ASSERT_EQ(row.hl[2], HL_NUMBER);
-    ASSERT_EQ(row.hl[3], HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 3), HL_NUMBER);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -374,9 +513,9 @@ TEST(syntax_number_not_after_letter) {
 
     /* "abc123" should not be highlighted as number (no separator before digit) */
     /* It will be normal text */
-    ASSERT_EQ(row.hl[3], HL_NORMAL);
-    ASSERT_EQ(row.hl[4], HL_NORMAL);
-    ASSERT_EQ(row.hl[5], HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 3), HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 4), HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&row, 5), HL_NORMAL);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -394,9 +533,9 @@ TEST(syntax_separator_space) {
     init_c_syntax_row(&ctx, &row, "if return");
 
     /* Both keywords should be detected (space is separator) */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);  /* if */
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[3], HL_KEYWORD1);  /* return */
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);  /* if */
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 3), HL_KEYWORD1);  /* return */
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -410,8 +549,8 @@ TEST(syntax_separator_paren) {
     init_c_syntax_row(&ctx, &row, "if(");
 
     /* "if" should be detected (paren is separator) */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -431,8 +570,7 @@ TEST(syntax_python_comment) {
     row.size = strlen(row.chars);
     row.render = strdup(row.chars);
     row.rsize = strlen(row.render);
-    row.hl = calloc(row.rsize, 1);
-    row.idx = 0;
+    row.hl_buf.hl = calloc(row.rsize, 1);
 
     /* Set Python syntax */
     extern struct t_editor_syntax HLDB[];
@@ -442,7 +580,7 @@ TEST(syntax_python_comment) {
 
     /* Single-character comment delimiters like "#" should work correctly */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_COMMENT);  /* Entire line is a comment */
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_COMMENT);  /* Entire line is a comment */
     }
 
     free_row(&row);
@@ -459,8 +597,7 @@ TEST(syntax_lua_comment) {
     row.size = strlen(row.chars);
     row.render = strdup(row.chars);
     row.rsize = strlen(row.render);
-    row.hl = calloc(row.rsize, 1);
-    row.idx = 0;
+    row.hl_buf.hl = calloc(row.rsize, 1);
 
     /* Set Lua syntax */
     extern struct t_editor_syntax HLDB[];
@@ -470,7 +607,7 @@ TEST(syntax_lua_comment) {
 
     /* Lua comment should be HL_COMMENT */
     for (int i = 0; i < row.rsize; i++) {
-        ASSERT_EQ(row.hl[i], HL_COMMENT);
+        ASSERT_EQ(editor_row_hl_at(&row, i), HL_COMMENT);
     }
 
     free_row(&row);
@@ -487,8 +624,7 @@ TEST(syntax_python_keyword) {
     row.size = strlen(row.chars);
     row.render = strdup(row.chars);
     row.rsize = strlen(row.render);
-    row.hl = calloc(row.rsize, 1);
-    row.idx = 0;
+    row.hl_buf.hl = calloc(row.rsize, 1);
 
     /* Set Python syntax */
     extern struct t_editor_syntax HLDB[];
@@ -497,9 +633,9 @@ TEST(syntax_python_keyword) {
     syntax_update_row(&ctx, &row);
 
     /* "def" should be KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[2], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 2), HL_KEYWORD1);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -515,8 +651,7 @@ TEST(syntax_lua_keyword) {
     row.size = strlen(row.chars);
     row.render = strdup(row.chars);
     row.rsize = strlen(row.render);
-    row.hl = calloc(row.rsize, 1);
-    row.idx = 0;
+    row.hl_buf.hl = calloc(row.rsize, 1);
 
     /* Set Lua syntax */
     extern struct t_editor_syntax HLDB[];
@@ -525,8 +660,8 @@ TEST(syntax_lua_keyword) {
     syntax_update_row(&ctx, &row);
 
     /* "function" should be KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
-    ASSERT_EQ(row.hl[1], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 1), HL_KEYWORD1);
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -544,12 +679,12 @@ TEST(syntax_mixed_keyword_and_string) {
     init_c_syntax_row(&ctx, &row, "return \"text\";");
 
     /* "return" should be KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
 
     /* String should be HL_STRING */
-    ASSERT_EQ(row.hl[7], HL_STRING);  /* Opening quote */
-    ASSERT_EQ(row.hl[8], HL_STRING);  /* 't' */
-    ASSERT_EQ(row.hl[12], HL_STRING); /* Closing quote */
+    ASSERT_EQ(editor_row_hl_at(&row, 7), HL_STRING);  /* Opening quote */
+    ASSERT_EQ(editor_row_hl_at(&row, 8), HL_STRING);  /* 't' */
+    ASSERT_EQ(editor_row_hl_at(&row, 12), HL_STRING); /* Closing quote */
 
     free_row(&row);
     editor_ctx_free(&ctx);
@@ -563,16 +698,573 @@ TEST(syntax_mixed_keyword_and_number) {
     init_c_syntax_row(&ctx, &row, "return 42;");
 
     /* "return" should be KEYWORD1 */
-    ASSERT_EQ(row.hl[0], HL_KEYWORD1);
+    ASSERT_EQ(editor_row_hl_at(&row, 0), HL_KEYWORD1);
 
     /* Number should be HL_NUMBER */
-    ASSERT_EQ(row.hl[7], HL_NUMBER);
-    ASSERT_EQ(row.hl[8], HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 7), HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&row, 8), HL_NUMBER);
 
     free_row(&row);
     editor_ctx_free(&ctx);
 }
 
+/* ============================================================================
+ * Theme Escape Table Tests
+ * ============================================================================ */
+
+TEST(syntax_color_sgr_follows_theme_changes) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    syntax_init_default_colors(&ctx);
+
+    int len;
+    const char *sgr = syntax_color_sgr(&ctx, HL_STRING, &len);
+    ASSERT_STR_EQ(sgr, "\x1b[38;2;220;220;100m");
+    ASSERT_EQ(len, (int)strlen(sgr));
+
+    /* The table is only rebuilt when told the theme changed */
+    ctx.view.colors[HL_STRING].r = 1;
+    ASSERT_STR_EQ(syntax_color_sgr(&ctx, HL_STRING, &len), "\x1b[38;2;220;220;100m");
+    syntax_colors_changed(&ctx);
+    ASSERT_STR_EQ(syntax_color_sgr(&ctx, HL_STRING, &len), "\x1b[38;2;1;220;100m");
+
+    char buf[32];
+    ASSERT_EQ(syntax_format_color(&ctx, HL_STRING, buf, sizeof(buf)), len);
+    ASSERT_STR_EQ(buf, "\x1b[38;2;1;220;100m");
+
+    editor_ctx_free(&ctx);
+}
+
+/* ============================================================================
+ * Keyword Table Tests
+ * ============================================================================ */
+
+/* Highlight 'text' with 'syntax' into hl (row->rsize bytes) */
+static void highlight_with(struct t_editor_syntax *syntax, const char *text,
+                           unsigned char *hl) {
+    editor_ctx_t ctx;
+    t_erow row;
+    editor_ctx_init(&ctx);
+    memset(&row, 0, sizeof(row));
+    row.chars = strdup(text);
+    row.size = strlen(text);
+    row.render = strdup(text);
+    row.rsize = strlen(text);
+    row.hl_buf.hl = calloc(row.rsize, 1);
+    ctx.view.syntax = syntax;
+    syntax_update_row(&ctx, &row);
+    memcpy(hl, editor_row_hl(&row), row.rsize);     /* Packed or not */
+    free_row(&row);
+    editor_ctx_free(&ctx);
+}
+
+TEST(syntax_keyword_table_matches_linear_scan) {
+    char *keywords[] = {
+        "if", "int|", "foo", "foo.bar", "std.io|", "select", "SELECT|",
+        "if|", "x", "(", NULL
+    };
+    char seps[] = ",.()+-/*=~%<>[]{}:;";
+    struct t_editor_syntax linear = {
+        NULL, keywords, "//", "/*", "*/", seps,
+        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS, HL_TYPE_C, NULL, NULL
+    };
+    struct t_editor_syntax hashed = linear;
+    ASSERT_EQ(syntax_compile_keywords(&hashed), 0);
+    ASSERT_NOT_NULL(hashed.kwtable);
+
+    const char *lines[] = {
+        "if (int x) foo.bar(std.io);",
+        "iff ifint SELECT select selects x.x",
+        "std.iox foo.barz foo foo.bar.baz",
+        "( (x) int",
+    };
+    for (int i = 0; i < 4; i++) {
+        unsigned char a[64], b[64];
+        highlight_with(&linear, lines[i], a);
+        highlight_with(&hashed, lines[i], b);
+        ASSERT_TRUE(memcmp(a, b, strlen(lines[i])) == 0);
+    }
+
+    /* Keyword order still decides: "foo" is listed before "foo.bar" */
+    unsigned char hl[64];
+    highlight_with(&hashed, "foo.bar", hl);
+    ASSERT_EQ(hl[0], HL_KEYWORD1);
+    ASSERT_EQ(hl[4], HL_NORMAL);
+    /* "std.io|" spans a separator and is a type keyword */
+    highlight_with(&hashed, "std.io", hl);
+    ASSERT_EQ(hl[5], HL_KEYWORD2);
+    /* The first of two duplicates wins */
+    highlight_with(&hashed, "if", hl);
+    ASSERT_EQ(hl[0], HL_KEYWORD1);
+
+    syntax_free_keywords(&hashed);
+    ASSERT_NULL(hashed.kwtable);
+}
+
+/* The built-in languages' generated highlighters (syntax/hlgen.c) give
+ * what the generic rules give with the same definition */
+TEST(syntax_generated_highlighters_match_the_rules) {
+    const char *lines[] = {
+        "if (x) return 1; // done",
+        "  int x = 12.5 + .5 * 3. - a1 + 1a;",
+        "char *s = \"a\\\"b\" 'c' \"open",
+        "/* block */ while /* still open",
+        "def f(a): return str(a)  # note",
+        "local function end_(x) -- comment",
+        "(define (f x) (let* ((y x)) (null? y))) ; c",
+        "set! 'quoted `quasi ,unq @splice #t",
+        "elif else elseif NULL null?x ifx xif",
+        "\x01\x7f tab\tafter",
+        "--[[ x ]] // # ; -- /",
+    };
+    int nlines = (int)(sizeof(lines) / sizeof(lines[0]));
+    extern struct t_editor_syntax HLDB[];
+    int generated = 0;
+
+    for (unsigned int j = 0; j < loki_get_builtin_language_count(); j++) {
+        if (HLDB[j].type != HL_TYPE_GENERATED) continue;
+        ASSERT_NOT_NULL(HLDB[j].scan);
+        struct t_editor_syntax rules = HLDB[j];
+        rules.type = HL_TYPE_C;
+        rules.scan = NULL;
+        rules.kwtable = NULL;
+        ASSERT_EQ(syntax_compile_keywords(&rules), 0);
+        for (int i = 0; i < nlines; i++) {
+            unsigned char a[64], b[64];
+            highlight_with(&HLDB[j], lines[i], a);
+            highlight_with(&rules, lines[i], b);
+            ASSERT_TRUE(memcmp(a, b, strlen(lines[i])) == 0);
+        }
+        syntax_free_keywords(&rules);
+        generated++;
+    }
+    ASSERT_EQ(generated, 4);     /* C, Python, Lua, Scheme */
+
+    /* A comment left open carries into the next row */
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.syntax = &HLDB[0];
+    editor_insert_row(&ctx, 0, "x /* open", 9);
+    editor_insert_row(&ctx, 1, "still */ if", 11);
+    t_erow *row = syntax_fresh_row(&ctx, 1);
+    ASSERT_EQ(editor_row_hl_at(row, 0), HL_MLCOMMENT);
+    ASSERT_EQ(editor_row_hl_at(row, 7), HL_MLCOMMENT);
+    ASSERT_EQ(editor_row_hl_at(row, 9), HL_KEYWORD1);
+    ASSERT_TRUE(syntax_rows_thread_safe(&ctx));
+    editor_ctx_free(&ctx);
+}
+
+TEST(syntax_char_classes_match_linear_scan) {
+    char *keywords[] = { "return", "int|", "x_y", NULL };
+    char seps[] = ",.()+-/*=~%<>[]{}:;";
+    char letter_seps[] = ",.()q;";   /* A letter separates: no vector skip */
+    struct t_editor_syntax defs[2] = {
+        { NULL, keywords, "#", "/*", "*/", seps,
+          HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS, HL_TYPE_C, NULL, NULL },
+        { NULL, keywords, "--", "{-", "-}", letter_seps,
+          HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS, HL_TYPE_C, NULL, NULL },
+    };
+    const char *lines[] = {
+        "a_very_long_identifier_name_with_digits_0123456789 return x_y;",
+        "abcdefghijklmnopqrstuvwxyz0123456789#not a comment # but this is",
+        "caf\xc3\xa9_na\xc3\xafve_identifier_over_sixteen_bytes int 42 \"s\"",
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx/*c*/yyyyyyyyyyyyyyyyy'q' 7.5",
+        "lengthyidentifierquitelongindeed{-x-}int x_y 0x1f _9 \x01\x7f",
+        "int_ x_y_ return_ _return 12ab34 ab12 3.14.15",
+    };
+    for (int d = 0; d < 2; d++) {
+        struct t_editor_syntax compiled = defs[d];
+        ASSERT_EQ(syntax_compile_keywords(&compiled), 0);
+        ASSERT_NOT_NULL(syntax_char_classes(&compiled));
+        for (int i = 0; i < 6; i++) {
+            unsigned char a[128], b[128];
+            highlight_with(&defs[d], lines[i], a);
+            highlight_with(&compiled, lines[i], b);
+            ASSERT_TRUE(memcmp(a, b, strlen(lines[i])) == 0);
+        }
+        syntax_free_keywords(&compiled);
+    }
+
+    /* Classes follow the definition */
+    struct t_editor_syntax compiled = defs[1];
+    ASSERT_EQ(syntax_compile_keywords(&compiled), 0);
+    const unsigned char *cc = syntax_char_classes(&compiled);
+    ASSERT_TRUE(cc['q'] & SYNTAX_CC_SEP);
+    ASSERT_TRUE(cc['-'] & SYNTAX_CC_COMMENT);
+    ASSERT_TRUE(cc['{'] & SYNTAX_CC_COMMENT);
+    ASSERT_TRUE(cc['\''] & SYNTAX_CC_QUOTE);
+    ASSERT_TRUE(cc['7'] & SYNTAX_CC_DIGIT);
+    ASSERT_TRUE(cc['7'] & SYNTAX_CC_WORD);
+    ASSERT_TRUE(cc[0xc3] & SYNTAX_CC_NONPRINT);
+    ASSERT_TRUE(cc['\t'] & SYNTAX_CC_SPACE);
+    ASSERT_FALSE(cc['z'] & SYNTAX_CC_SEP);
+    syntax_free_keywords(&compiled);
+}
+
+TEST(markdown_code_block_uses_compiled_rules) {
+    unsigned char hl[64];
+    t_erow row;
+    memset(&row, 0, sizeof(row));
+    const char *text = "return x # done";
+    row.render = (char *)text;
+    row.rsize = strlen(text);
+    row.hl_buf.hl = hl;
+    memset(hl, HL_NORMAL, sizeof(hl));
+
+    struct t_editor_syntax py = {
+        NULL, (char *[]){ "return", NULL }, "#", "", "",
+        (char *)",.()+-/*=~%[];", 0, HL_TYPE_C, NULL, NULL
+    };
+    ASSERT_EQ(syntax_compile_keywords(&py), 0);
+    highlight_code_line(&row, &py);
+    ASSERT_EQ(hl[0], HL_KEYWORD1);
+    ASSERT_EQ(hl[5], HL_KEYWORD1);
+    ASSERT_EQ(hl[7], HL_NORMAL);
+    ASSERT_EQ(hl[9], HL_COMMENT);
+    syntax_free_keywords(&py);
+}
+
+TEST(markdown_fence_index_follows_edits) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    const char *head[] = { "# Title", "```python", "def f(): pass", "```" };
+    for (int i = 0; i < 4; i++)
+        editor_insert_row(&ctx, i, (char *)head[i], strlen(head[i]));
+    for (int i = 4; i < 2000; i++) editor_insert_row(&ctx, i, "def g", 5);
+    extern struct t_editor_syntax HLDB[];
+    for (unsigned int j = 0; j < loki_get_builtin_language_count(); j++)
+        if (HLDB[j].type == HL_TYPE_MARKDOWN) ctx.view.syntax = &HLDB[j];
+    ASSERT_NOT_NULL(ctx.view.syntax);
+
+    /* Far down the document, without highlighting the rows above */
+    syntax_fresh_rows(&ctx, 1000, 1010);
+    ASSERT_EQ(ctx.model.row[1005].cb_lang, CB_LANG_NONE);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[1005], 0), HL_NORMAL);
+    ASSERT_TRUE(ctx.model.row[500].hl_stale);
+    ASSERT_TRUE(ctx.model.row[2].hl_stale);
+
+    /* Without the closing fence the rest is Python */
+    editor_del_row(&ctx, 3);
+    syntax_fresh_rows(&ctx, 1000, 1010);
+    ASSERT_EQ(ctx.model.row[1005].cb_lang, CB_LANG_PYTHON);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[1005], 0), HL_KEYWORD1);
+
+    /* Closing it again further down ends the block there */
+    editor_insert_row(&ctx, 1002, "```", 3);
+    syntax_fresh_rows(&ctx, 1000, 1010);
+    ASSERT_EQ(ctx.model.row[1001].cb_lang, CB_LANG_PYTHON);
+    ASSERT_EQ(ctx.model.row[1002].cb_lang, CB_LANG_NONE);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[1002], 0), HL_STRING);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[1005], 0), HL_NORMAL);
+    ASSERT_EQ(markdown_entry_state(&ctx, 2), CB_LANG_PYTHON);
+
+    editor_ctx_free(&ctx);
+}
+
+TEST(syntax_select_compiles_keywords) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    syntax_select_for_filename(&ctx, (char *)"main.c");
+    ASSERT_NOT_NULL(ctx.view.syntax);
+    ASSERT_NOT_NULL(ctx.view.syntax->kwtable);
+    editor_ctx_free(&ctx);
+}
+
+/* A dynamic language as loki.register_language() builds it */
+static struct t_editor_syntax *new_dynamic_syntax(const char *ext,
+                                                  const char *name) {
+    struct t_editor_syntax *s = calloc(1, sizeof(*s));
+    s->filematch = calloc(3, sizeof(char *));
+    s->filematch[0] = strdup(ext);
+    s->filematch[1] = strdup(name);
+    s->type = HL_TYPE_C;
+    return s;
+}
+
+/* Languages are looked up once per filename and registry generation */
+TEST(buffer_languages_are_cached_until_a_registry_changes) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+
+    char py[] = "tool.py";
+    ctx.model.filename = py;
+    const EditorLang *lang = loki_lang_resolve(&ctx);
+    ASSERT_NOT_NULL(lang->syntax);
+    ASSERT_TRUE(lang->syntax == syntax_for_filename("x.py"));
+    unsigned long gen = lang->gen;
+    ASSERT_TRUE(loki_lang_resolve(&ctx)->gen == gen);
+
+    /* The first occurrence of a pattern decides, as with strstr() */
+    ASSERT_NULL(syntax_for_filename("a.c.bak"));
+    ASSERT_NULL(syntax_for_filename("a.py.c.py"));
+
+    char zz[] = "song.zz";
+    ctx.model.filename = zz;
+    ASSERT_NULL(loki_lang_resolve(&ctx)->syntax);
+
+    struct t_editor_syntax *dyn = new_dynamic_syntax(".zz", "Zzfile");
+    ASSERT_EQ(add_dynamic_language(dyn), 0);
+    ASSERT_TRUE(loki_lang_generation() != gen);
+    ASSERT_TRUE(loki_lang_resolve(&ctx)->syntax == dyn);
+    ASSERT_TRUE(syntax_for_filename("build/Zzfile") == dyn);
+    syntax_select_for_filename(&ctx, ctx.model.filename);
+    ASSERT_TRUE(ctx.view.syntax == dyn);
+
+    /* Built-in languages keep their extensions */
+    struct t_editor_syntax *shadow = new_dynamic_syntax(".py", "Pyfile");
+    ASSERT_EQ(add_dynamic_language(shadow), 0);
+    ASSERT_TRUE(syntax_for_filename("x.py") != shadow);
+    ASSERT_TRUE(syntax_for_filename("Pyfile") == shadow);
+
+    ctx.model.filename = NULL;
+    ctx.view.syntax = NULL;
+    editor_ctx_free(&ctx);
+    cleanup_dynamic_languages();
+}
+
+/* ============================================================================
+ * Tree-sitter Tests
+ * ============================================================================ */
+
+#ifdef LOKI_USE_LINENOISE
+
+void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at);
+void editor_del_row(editor_ctx_t *ctx, int at);
+void editor_row_insert_char(editor_ctx_t *ctx, t_erow *row, int at, int c);
+
+/* Context with the rows of 'lines', highlighted by tree-sitter */
+static void init_ts_ctx(editor_ctx_t *ctx, const char *lang, int n,
+                        const char **lines) {
+    editor_ctx_init(ctx);
+    ctx->model.ts_state = treesitter_init(lang);
+    for (int i = 0; i < n; i++)
+        editor_insert_row(ctx, i, (char *)lines[i], strlen(lines[i]));
+}
+
+static void free_ts_ctx(editor_ctx_t *ctx) {
+    treesitter_free(ctx->model.ts_state);
+    ctx->model.ts_state = NULL;
+    editor_ctx_free(ctx);
+}
+
+TEST(treesitter_highlights_constructs_spanning_rows) {
+    const char *lines[] = { "local x = 1", "--[[ block", "comment ]]", "x = 2" };
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "lua", 4, lines);
+    ASSERT_NOT_NULL(ctx.model.ts_state);
+
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 0), 0), HL_KEYWORD1);  /* local */
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 1), 5), HL_COMMENT);
+    /* A row in the middle of the comment is still part of it */
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 2), 0), HL_COMMENT);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 3), 4), HL_NUMBER);
+
+    free_ts_ctx(&ctx);
+}
+
+TEST(treesitter_edits_reparse_incrementally) {
+    const char *lines[] = { "x = 1", "--[[ block", "y = 2 ]]", "z = 3" };
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "lua", 4, lines);
+
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 2), 4), HL_COMMENT);
+    TSTree *tree = ctx.model.ts_state->tree;
+    ASSERT_NOT_NULL(tree);
+
+    /* Turning "--[[" into "--[" makes a line comment: the row below, which
+     * was not edited, must change too */
+    editor_row_del_char(&ctx, &ctx.model.row[1], 2);
+    ASSERT_TRUE(ctx.model.ts_state->stale);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 2), 4), HL_NUMBER);
+    ASSERT_FALSE(ctx.model.ts_state->stale);
+
+    /* Rows inserted and deleted keep the tree in step with the text */
+    editor_insert_row(&ctx, 0, (char *)"-- new", 6);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 0), 3), HL_COMMENT);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 4), 4), HL_NUMBER);
+    editor_del_row(&ctx, 0);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&ctx, 0), 4), HL_NUMBER);
+
+    /* The tree matches a parse of the text from scratch */
+    char *expect = ts_node_string(ts_tree_root_node(ctx.model.ts_state->tree));
+    treesitter_reset(ctx.model.ts_state);
+    syntax_fresh_row(&ctx, 0);
+    char *fresh = ts_node_string(ts_tree_root_node(ctx.model.ts_state->tree));
+    ASSERT_STR_EQ(expect, fresh);
+    free(expect);
+    free(fresh);
+
+    free_ts_ctx(&ctx);
+}
+
+TEST(treesitter_highlights_only_the_viewport) {
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "python", 0, NULL);
+    for (int i = 0; i < 5000; i++)
+        editor_insert_row(&ctx, i, (char *)"x = 1  # note", 13);
+
+    syntax_fresh_rows(&ctx, 4000, 4024);
+    ASSERT_FALSE(ctx.model.row[4000].hl_stale);
+    ASSERT_FALSE(ctx.model.row[4023].hl_stale);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[4010], 4), HL_NUMBER);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[4010], 8), HL_COMMENT);
+    /* Rows off screen are never queried */
+    ASSERT_TRUE(ctx.model.row[0].hl_stale);
+    ASSERT_TRUE(ctx.model.row[4024].hl_stale);
+
+    /* An edit re-queries the row it touched, not the rest of the screen */
+    editor_row_hl(&ctx.model.row[4005])[0] = HL_MATCH;
+    editor_row_del_char(&ctx, &ctx.model.row[4010], 7);  /* Drop the '#' */
+    syntax_fresh_rows(&ctx, 4000, 4024);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[4005], 0), HL_MATCH);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[4010], 8), HL_NORMAL);
+
+    free_ts_ctx(&ctx);
+}
+
+/* Dispatch async events until the background parse has landed */
+static int wait_for_parse(editor_ctx_t *ctx) {
+    for (int i = 0; i < 5000 && ctx->model.ts_state->job; i++) {
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+        async_queue_dispatch_all(NULL, ctx);
+    }
+    return ctx->model.ts_state->job == NULL;
+}
+
+TEST(treesitter_parses_big_documents_off_thread) {
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "python", 0, NULL);
+    int rows = TS_ASYNC_MIN_BYTES / 14 + 100;
+    for (int i = 0; i < rows; i++)
+        editor_insert_row(&ctx, i, (char *)"x = 1  # note", 13);
+
+    /* The first sync only starts the worker; rows stay plain until then */
+    syntax_fresh_rows(&ctx, 0, 24);
+    ASSERT_NOT_NULL(ctx.model.ts_state->job);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[10], 8), HL_NORMAL);
+
+    ASSERT_TRUE(wait_for_parse(&ctx));
+    ASSERT_NOT_NULL(ctx.model.ts_state->tree);
+    ASSERT_TRUE(ctx.model.row[10].hl_stale);
+    syntax_fresh_rows(&ctx, 0, 24);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[10], 8), HL_COMMENT);
+
+    /* An edit while a parse runs cancels it; the rows keep the highlight
+     * of the shifted tree meanwhile */
+    editor_row_insert_char(&ctx, &ctx.model.row[10], 0, ' ');
+    syntax_fresh_rows(&ctx, 0, 24);
+    ASSERT_NOT_NULL(ctx.model.ts_state->job);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[10], 9), HL_COMMENT);
+    editor_row_del_char(&ctx, &ctx.model.row[10], 8);  /* Drop the '#' */
+    ASSERT_TRUE(wait_for_parse(&ctx));
+    ASSERT_TRUE(ctx.model.ts_state->stale);  /* The result was outdated */
+
+    syntax_fresh_rows(&ctx, 0, 24);
+    ASSERT_TRUE(wait_for_parse(&ctx));
+    ASSERT_FALSE(ctx.model.ts_state->stale);
+    syntax_fresh_rows(&ctx, 0, 24);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[10], 9), HL_NORMAL);
+    ASSERT_EQ(editor_row_hl_at(&ctx.model.row[11], 8), HL_COMMENT);
+
+    free_ts_ctx(&ctx);
+    async_queue_cleanup();
+}
+
+TEST(treesitter_buffers_share_queries_and_pooled_parsers) {
+    const char *a_lines[] = { "def f():", "    return 1" };
+    const char *b_lines[] = { "# note", "x = 2" };
+    editor_ctx_t a, b;
+    init_ts_ctx(&a, "python", 2, a_lines);
+    init_ts_ctx(&b, "python", 2, b_lines);
+    ASSERT_NOT_NULL(a.model.ts_state);
+    ASSERT_NOT_NULL(b.model.ts_state);
+
+    /* The query is compiled by the first highlighting, not before */
+    ASSERT_NULL(a.model.ts_state->query);
+    syntax_fresh_row(&a, 0);
+    syntax_fresh_row(&b, 0);
+    ASSERT_NOT_NULL(a.model.ts_state->query);
+
+    /* One compiled query for the language, its own parser and cursor each */
+    ASSERT_TRUE(a.model.ts_state->query == b.model.ts_state->query);
+    ASSERT_TRUE(a.model.ts_state->parser != b.model.ts_state->parser);
+    ASSERT_TRUE(a.model.ts_state->cursor != b.model.ts_state->cursor);
+
+    /* Closing one leaves the query to the other, and its parser to the
+     * next buffer */
+    TSParser *parser = a.model.ts_state->parser;
+    free_ts_ctx(&a);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&b, 0), 0), HL_COMMENT);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&b, 1), 4), HL_NUMBER);
+    init_ts_ctx(&a, "python", 2, a_lines);
+    ASSERT_TRUE(a.model.ts_state->parser == parser);
+    ASSERT_EQ(editor_row_hl_at(syntax_fresh_row(&a, 1), 11), HL_NUMBER);
+
+    free_ts_ctx(&a);
+    free_ts_ctx(&b);
+}
+
+TEST(treesitter_reindents_by_the_tree) {
+    /* Lua's blocks have no brackets; the lines start all wrong */
+    const char *lines[] = { "local function f(a)", "if a then", "return {", "1,",
+                            "}", "else", "        x()", "end", "  end", "print(1)" };
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "lua", 10, lines);
+    syntax_fresh_row(&ctx, 0);
+    ASSERT_EQ(indent_reindent(&ctx, 0, 9), 7);
+    int expect[] = { 0, 4, 8, 12, 8, 4, 8, 4, 0, 0 };
+    for (int i = 0; i < 10; i++) ASSERT_EQ(indent_get_level(&ctx, i), expect[i]);
+
+    /* A range follows the lines above it as they are; nothing left to do */
+    ASSERT_EQ(indent_reindent(&ctx, 3, 6), 0);
+    free_ts_ctx(&ctx);
+
+    /* Python: lines inside brackets, and the closer */
+    const char *py[] = { "def f(a,", "b):", "    return [", "1,", "]" };
+    init_ts_ctx(&ctx, "python", 5, py);
+    syntax_fresh_row(&ctx, 0);
+    ASSERT_EQ(indent_reindent(&ctx, 0, 4), 3);
+    ASSERT_EQ(indent_get_level(&ctx, 1), 4);
+    ASSERT_EQ(indent_get_level(&ctx, 3), 8);
+    ASSERT_EQ(indent_get_level(&ctx, 4), 4);
+    free_ts_ctx(&ctx);
+}
+
+TEST(treesitter_folds_and_selects_around_the_cursor) {
+    const char *lines[] = { "local function f(a)", "  return {", "    1,", "  }",
+                            "end", "print(1)" };
+    editor_ctx_t ctx;
+    init_ts_ctx(&ctx, "lua", 6, lines);
+    syntax_fresh_row(&ctx, 0);
+
+    /* zf: the innermost node over several rows holding the row */
+    ASSERT_EQ(fold_syntax_at(&ctx, 2), 1);
+    ASSERT_EQ(fold_count(ctx.model.folds), 1);
+    ASSERT_EQ(fold_closed_last(ctx.model.folds, 1), 3);
+    ASSERT_EQ(fold_syntax_at(&ctx, 5), -1);
+
+    /* Visual +/-: out to the call, and back in to where it started */
+    TsRange r = { 5, 6, 5, 7 };
+    ASSERT_TRUE(treesitter_grow_node(ctx.model.ts_state, &r));
+    ASSERT_TRUE(r.start_col == 5 && r.end_col == 8);    /* (1) */
+    ASSERT_TRUE(treesitter_grow_node(ctx.model.ts_state, &r));
+    ASSERT_TRUE(r.start_col == 0 && r.end_col == 8);    /* print(1) */
+    ASSERT_TRUE(treesitter_shrink_node(ctx.model.ts_state, &r, 5, 6));
+    ASSERT_TRUE(treesitter_shrink_node(ctx.model.ts_state, &r, 5, 6));
+    ASSERT_TRUE(r.start_row == 5 && r.start_col == 6 && r.end_col == 7);
+    ASSERT_FALSE(treesitter_shrink_node(ctx.model.ts_state, &r, 5, 6));
+
+    free_ts_ctx(&ctx);
+    editor_ctx_t plain;
+    editor_ctx_init(&plain);
+    ASSERT_EQ(fold_syntax_at(&plain, 0), -2);
+    editor_ctx_free(&plain);
+}
+
+#endif /* LOKI_USE_LINENOISE */
+
 BEGIN_TEST_SUITE("Syntax Highlighting")
     /* Keyword tests */
     RUN_TEST(syntax_c_keyword1_if);
@@ -592,6 +1284,10 @@ BEGIN_TEST_SUITE("Syntax Highlighting")
     RUN_TEST(syntax_c_multiline_comment_start);
     RUN_TEST(syntax_c_multiline_comment_complete);
     RUN_TEST(syntax_c_multiline_comment_continuation);
+    RUN_TEST(syntax_far_jump_is_bounded_per_frame);
+    RUN_TEST(syntax_far_jump_catches_up_in_idle_time);
+    RUN_TEST(syntax_update_row_marks_rows_below_for_catch_up);
+    RUN_TEST(syntax_row_hook_batches_fresh_rows);
 
     /* Number tests */
     RUN_TEST(syntax_number_integer);
@@ -612,4 +1308,27 @@ BEGIN_TEST_SUITE("Syntax Highlighting")
     /* Mixed content tests */
     RUN_TEST(syntax_mixed_keyword_and_string);
     RUN_TEST(syntax_mixed_keyword_and_number);
+
+    /* Theme tests */
+    RUN_TEST(syntax_color_sgr_follows_theme_changes);
+
+    /* Keyword table tests */
+    RUN_TEST(syntax_keyword_table_matches_linear_scan);
+    RUN_TEST(syntax_char_classes_match_linear_scan);
+    RUN_TEST(syntax_generated_highlighters_match_the_rules);
+    RUN_TEST(markdown_code_block_uses_compiled_rules);
+    RUN_TEST(markdown_fence_index_follows_edits);
+    RUN_TEST(syntax_select_compiles_keywords);
+    RUN_TEST(buffer_languages_are_cached_until_a_registry_changes);
+
+#ifdef LOKI_USE_LINENOISE
+    /* Tree-sitter tests */
+    RUN_TEST(treesitter_highlights_constructs_spanning_rows);
+    RUN_TEST(treesitter_edits_reparse_incrementally);
+    RUN_TEST(treesitter_highlights_only_the_viewport);
+    RUN_TEST(treesitter_parses_big_documents_off_thread);
+    RUN_TEST(treesitter_buffers_share_queries_and_pooled_parsers);
+    RUN_TEST(treesitter_reindents_by_the_tree);
+    RUN_TEST(treesitter_folds_and_selects_around_the_cursor);
+#endif
 END_TEST_SUITE()
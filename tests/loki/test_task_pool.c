@@ -0,0 +1,267 @@
+/* test_task_pool.c - Unit tests for the shared task pool
+ *
+ * Tests for:
+ * - Running submitted tasks and waiting for them
+ * - A task not started yet being run by the thread waiting for it
+ * - Cancelled tokens keeping tasks from running, and task_cancelled()
+ * - A worker's own tasks, highest priority and newest first
+ * - Tasks submitting and waiting for more, and work stealing
+ * - task_post() reporting through the async event queue
+ * - Shutting down with tasks queued, and starting again
+ */
+
+#include "test_framework.h"
+#include "task_pool.h"
+#include "async_queue.h"
+#include <uv.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define TEST_POST_EVENT (ASYNC_EVENT_USER + 30)
+
+static void pause_us(long us) {
+    struct timespec ts = {0, us * 1000};
+    nanosleep(&ts, NULL);
+}
+
+static void count_task(void *arg) {
+    atomic_fetch_add((atomic_int *)arg, 1);
+}
+
+/* Blockers hold pool threads until the gate opens */
+static atomic_int gate, blockers_started;
+
+static void blocker_task(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&blockers_started, 1);
+    while (!atomic_load(&gate)) pause_us(100);
+}
+
+/* Occupy 'n' of the pool's threads; returns their handles in 'tasks' */
+static void block_threads(Task **tasks, int n) {
+    atomic_store(&gate, 0);
+    atomic_store(&blockers_started, 0);
+    for (int i = 0; i < n; i++) tasks[i] = task_submit(blocker_task, NULL, TASK_PRIORITY_HIGH, NULL);
+    while (atomic_load(&blockers_started) < n) pause_us(100);
+}
+
+static void unblock_threads(Task **tasks, int n) {
+    atomic_store(&gate, 1);
+    for (int i = 0; i < n; i++) task_wait(tasks[i]);
+}
+
+static int pool_threads(void) {
+    TaskPoolStats stats;
+    Task *t = task_submit(count_task, &(atomic_int){0}, TASK_PRIORITY_NORMAL, NULL);
+    task_wait(t);
+    task_pool_stats(&stats);
+    return stats.threads;
+}
+
+TEST(submit_and_wait) {
+    atomic_int count = 0;
+    Task *tasks[100];
+    for (int i = 0; i < 100; i++) {
+        tasks[i] = task_submit(count_task, &count, i % TASK_PRIORITIES, NULL);
+        ASSERT_NOT_NULL(tasks[i]);
+    }
+    int ran = 0;
+    for (int i = 0; i < 100; i++) ran += task_wait(tasks[i]);
+    ASSERT_EQ(ran, 100);
+    ASSERT_EQ(atomic_load(&count), 100);
+    ASSERT_EQ(task_wait(NULL), 0);
+}
+
+static uv_thread_t ran_on;
+
+static void record_thread(void *arg) {
+    (void)arg;
+    ran_on = uv_thread_self();
+}
+
+TEST(wait_runs_unstarted_task_inline) {
+    int n = pool_threads();
+    Task *blockers[TASK_POOL_MAX_THREADS];
+    block_threads(blockers, n);
+
+    TaskPoolStats before, after;
+    task_pool_stats(&before);
+    Task *t = task_submit(record_thread, NULL, TASK_PRIORITY_NORMAL, NULL);
+    ASSERT_EQ(task_wait(t), 1);
+    uv_thread_t self = uv_thread_self();
+    ASSERT_TRUE(uv_thread_equal(&self, &ran_on));
+    task_pool_stats(&after);
+    ASSERT_EQ(after.inlined, before.inlined + 1);
+
+    unblock_threads(blockers, n);
+}
+
+static atomic_int saw_cancel, spinner_started;
+
+static void spin_until_cancelled(void *arg) {
+    (void)arg;
+    atomic_store(&spinner_started, 1);
+    while (!task_cancelled()) pause_us(100);
+    atomic_store(&saw_cancel, 1);
+}
+
+TEST(cancelled_token_skips_task) {
+    int n = pool_threads();
+    Task *blockers[TASK_POOL_MAX_THREADS];
+    atomic_int count = 0;
+    TaskToken token;
+    task_token_init(&token);
+
+    block_threads(blockers, n);
+    Task *t = task_submit(count_task, &count, TASK_PRIORITY_NORMAL, &token);
+    task_token_cancel(&token);
+    unblock_threads(blockers, n);
+    ASSERT_EQ(task_wait(t), 0);
+    ASSERT_EQ(atomic_load(&count), 0);
+
+    /* A running task sees its token cancelled */
+    ASSERT_FALSE(task_cancelled());
+    task_token_init(&token);
+    t = task_submit(spin_until_cancelled, NULL, TASK_PRIORITY_NORMAL, &token);
+    while (!atomic_load(&spinner_started)) pause_us(100);
+    task_token_cancel(&token);
+    ASSERT_EQ(task_wait(t), 1);
+    ASSERT_EQ(atomic_load(&saw_cancel), 1);
+}
+
+static atomic_int order_next;
+static int order[4];
+static Task *children[4];
+static atomic_int parent_done;
+
+static void record_order(void *arg) {
+    order[atomic_fetch_add(&order_next, 1)] = (int)(intptr_t)arg;
+}
+
+/* On a worker: its own deques, so nobody else can take these first */
+static void submit_children(void *arg) {
+    (void)arg;
+    children[0] = task_submit(record_order, (void *)1, TASK_PRIORITY_LOW, NULL);
+    children[1] = task_submit(record_order, (void *)2, TASK_PRIORITY_LOW, NULL);
+    children[2] = task_submit(record_order, (void *)3, TASK_PRIORITY_HIGH, NULL);
+    children[3] = task_submit(record_order, (void *)4, TASK_PRIORITY_HIGH, NULL);
+    atomic_store(&parent_done, 1);
+}
+
+TEST(own_tasks_by_priority_newest_first) {
+    int n = pool_threads();
+    Task *blockers[TASK_POOL_MAX_THREADS];
+    block_threads(blockers, n - 1);     /* One thread free */
+
+    Task *parent = task_submit(submit_children, NULL, TASK_PRIORITY_NORMAL, NULL);
+    while (!atomic_load(&parent_done)) pause_us(100);
+    while (atomic_load(&order_next) < 4) pause_us(100);
+    task_wait(parent);
+    for (int i = 0; i < 4; i++) ASSERT_EQ(task_wait(children[i]), 1);
+    ASSERT_EQ(order[0], 4);
+    ASSERT_EQ(order[1], 3);
+    ASSERT_EQ(order[2], 2);
+    ASSERT_EQ(order[3], 1);
+    unblock_threads(blockers, n - 1);
+}
+
+#define FAN_OUT 64
+
+static atomic_int leaves;
+
+static void slow_leaf(void *arg) {
+    (void)arg;
+    pause_us(500);
+    atomic_fetch_add(&leaves, 1);
+}
+
+/* Submit leaves and wait for them from a worker */
+static void fan_out(void *arg) {
+    (void)arg;
+    Task *tasks[FAN_OUT];
+    for (int i = 0; i < FAN_OUT; i++)
+        tasks[i] = task_submit(slow_leaf, NULL, TASK_PRIORITY_NORMAL, NULL);
+    for (int i = 0; i < FAN_OUT; i++) task_wait(tasks[i]);
+}
+
+TEST(nested_submits_are_stolen) {
+    int n = pool_threads();
+    TaskPoolStats before, after;
+    task_pool_stats(&before);
+
+    Task *roots[4];
+    for (int i = 0; i < 4; i++) roots[i] = task_submit(fan_out, NULL, TASK_PRIORITY_NORMAL, NULL);
+    for (int i = 0; i < 4; i++) ASSERT_EQ(task_wait(roots[i]), 1);
+    ASSERT_EQ(atomic_load(&leaves), 4 * FAN_OUT);
+
+    task_pool_stats(&after);
+    ASSERT_EQ(after.run - before.run, 4 + 4 * FAN_OUT);
+    if (n > 1) ASSERT_TRUE(after.stolen > before.stolen);
+}
+
+TEST(post_reports_through_queue) {
+    ASSERT_EQ(async_queue_init(), 0);
+    atomic_int count = 0;
+    ASSERT_EQ(task_post(count_task, &count, TASK_PRIORITY_NORMAL, NULL, TEST_POST_EVENT), 0);
+
+    AsyncEvent ev;
+    int got = 0;
+    for (int i = 0; i < 5000 && !got; i++) {
+        if (async_queue_poll(NULL, &ev) == 0 && ev.type == TEST_POST_EVENT) got = 1;
+        else pause_us(1000);
+    }
+    ASSERT_TRUE(got);
+    ASSERT_TRUE(ev.data.user.ptr == &count);
+    ASSERT_EQ(ev.data.user.i64[0], 1);
+    ASSERT_EQ(atomic_load(&count), 1);
+
+    /* A cancelled one still reports, as not run */
+    TaskToken token;
+    task_token_init(&token);
+    task_token_cancel(&token);
+    ASSERT_EQ(task_post(count_task, &count, TASK_PRIORITY_LOW, &token, TEST_POST_EVENT), 0);
+    got = 0;
+    for (int i = 0; i < 5000 && !got; i++) {
+        if (async_queue_poll(NULL, &ev) == 0 && ev.type == TEST_POST_EVENT) got = 1;
+        else pause_us(1000);
+    }
+    ASSERT_TRUE(got);
+    ASSERT_EQ(ev.data.user.i64[0], 0);
+    ASSERT_EQ(atomic_load(&count), 1);
+    async_queue_cleanup();
+
+    ASSERT_EQ(task_post(count_task, &count, TASK_PRIORITY_NORMAL, NULL, TEST_POST_EVENT), -1);
+}
+
+TEST(shutdown_finishes_queued_tasks_and_restarts) {
+    atomic_int count = 0;
+    Task *tasks[400];
+    for (int i = 0; i < 200; i++) tasks[i] = task_submit(slow_leaf, NULL, TASK_PRIORITY_LOW, NULL);
+    for (int i = 200; i < 400; i++) tasks[i] = task_submit(count_task, &count, TASK_PRIORITY_LOW, NULL);
+    task_pool_shutdown();
+
+    TaskPoolStats stats;
+    task_pool_stats(&stats);
+    ASSERT_EQ(stats.threads, 0);
+    ASSERT_EQ(atomic_load(&count), 200);
+    for (int i = 0; i < 400; i++) ASSERT_EQ(task_wait(tasks[i]), 1);
+    task_pool_shutdown();               /* Stopped already: nothing to do */
+
+    Task *t = task_submit(count_task, &count, TASK_PRIORITY_NORMAL, NULL);
+    ASSERT_NOT_NULL(t);
+    ASSERT_EQ(task_wait(t), 1);
+    ASSERT_EQ(atomic_load(&count), 201);
+    task_pool_stats(&stats);
+    ASSERT_EQ(stats.threads, task_pool_threads());
+    task_pool_shutdown();
+}
+
+BEGIN_TEST_SUITE("Task Pool")
+    RUN_TEST(submit_and_wait);
+    RUN_TEST(wait_runs_unstarted_task_inline);
+    RUN_TEST(cancelled_token_skips_task);
+    RUN_TEST(own_tasks_by_priority_newest_first);
+    RUN_TEST(nested_submits_are_stolen);
+    RUN_TEST(post_reports_through_queue);
+    RUN_TEST(shutdown_finishes_queued_tasks_and_restarts);
+END_TEST_SUITE()
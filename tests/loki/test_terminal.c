@@ -4,17 +4,24 @@
  * - Screen buffer append and management
  * - Buffer initialization and cleanup
  * - String building efficiency
+ * - Key reading from a pipe: escape sequences and bracketed paste
+ * - Presses of a motion key in a row folded into one event
+ * - SGR mouse reports, wheel turns and drags folded into one event
+ * - Keys recorded to a trace and replayed from it
  *
- * Note: Functions requiring actual terminal I/O (raw mode, key reading, etc.)
- * cannot be easily unit tested and are tested through integration tests.
+ * Note: Functions requiring actual terminal I/O (raw mode, window size,
+ * etc.) cannot be easily unit tested and are tested through integration
+ * tests.
  */
 
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
 #include "terminal.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* ============================================================================
  * Screen Buffer Tests
@@ -307,6 +314,228 @@ TEST(terminal_buffer_newlines) {
     terminal_buffer_free(&ab);
 }
 
+/* ============================================================================
+ * Key Reading Tests
+ * ============================================================================ */
+
+/* Helper: A pipe with 'len' bytes of 'input' waiting and its write end
+ * closed, so reading past them finds EOF instead of blocking. Returns the
+ * read end. */
+static int input_pipe(const char *input, size_t len) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    if (write(fds[1], input, len) != (ssize_t)len) len = 0;
+    close(fds[1]);
+    return fds[0];
+}
+
+TEST(terminal_read_key_parses_sequences) {
+    static const char input[] = "a\x1b[A\x1b[1;2C\x1b[3~\x1bOH\x1b[13;2u\x1b[99Xb";
+    int fd = input_pipe(input, sizeof(input) - 1);
+    ASSERT_TRUE(fd >= 0);
+
+    ASSERT_EQ(terminal_read_key(fd), 'a');
+    ASSERT_EQ(terminal_read_key(fd), ARROW_UP);
+    ASSERT_EQ(terminal_read_key(fd), SHIFT_ARROW_RIGHT);
+    ASSERT_EQ(terminal_read_key(fd), DEL_KEY);
+    ASSERT_EQ(terminal_read_key(fd), HOME_KEY);
+    ASSERT_EQ(terminal_read_key(fd), SHIFT_RETURN);
+    /* An unknown sequence is skipped whole */
+    ASSERT_EQ(terminal_read_key(fd), 'b');
+    ASSERT_FALSE(terminal_input_pending(fd));
+    close(fd);
+}
+
+TEST(terminal_read_key_lone_escape) {
+    /* ESC not starting a sequence, and one cut short: the keys after it
+     * are keys of their own */
+    static const char input[] = "\x1bx\x1b[";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    ASSERT_EQ(terminal_read_key(fd), ESC);
+    ASSERT_TRUE(terminal_input_pending(fd));
+    ASSERT_EQ(terminal_wait_input(fd, 0), 1);
+    ASSERT_EQ(terminal_read_key(fd), 'x');
+    ASSERT_EQ(terminal_read_key(fd), ESC);
+    ASSERT_EQ(terminal_read_key(fd), '[');
+    close(fd);
+}
+
+TEST(terminal_read_key_bracketed_paste) {
+    static const char input[] = "\x1b[200~one\r\ntwo\rthree\x1b[B\x1b[201~z";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    ASSERT_EQ(terminal_read_key(fd), PASTE_KEY);
+    size_t len;
+    const char *text = terminal_paste(&len);
+    /* Line breaks as LF, and the keys in it are text */
+    ASSERT_EQ((int)len, 16);
+    ASSERT_EQ(memcmp(text, "one\ntwo\nthree\x1b[B", len), 0);
+    ASSERT_EQ(terminal_read_key(fd), 'z');
+    close(fd);
+}
+
+TEST(terminal_read_key_paste_across_reads) {
+    /* A paste bigger than the input buffer, its end marker split between
+     * two reads */
+    size_t text_len = TERM_INPUT_SIZE - 6 - 3;
+    size_t total = 6 + text_len + 6 + 1;
+    char *input = malloc(total);
+    memcpy(input, "\x1b[200~", 6);
+    for (size_t i = 0; i < text_len; i++) input[6 + i] = (char)('a' + i % 26);
+    memcpy(input + 6 + text_len, "\x1b[201~!", 7);
+    int fd = input_pipe(input, total);
+
+    ASSERT_EQ(terminal_read_key(fd), PASTE_KEY);
+    size_t len;
+    const char *text = terminal_paste(&len);
+    ASSERT_EQ((int)len, (int)text_len);
+    ASSERT_EQ(memcmp(text, input + 6, text_len), 0);
+    ASSERT_EQ(terminal_read_key(fd), '!');
+    close(fd);
+    free(input);
+}
+
+TEST(terminal_paste_becomes_one_event) {
+    static const char input[] = "\x1b[200~hi\x1b[201~";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    EditorEvent ev = event_from_keycode(terminal_read_key(fd));
+    ASSERT_EQ(ev.type, EVENT_PASTE);
+    ASSERT_EQ((int)ev.data.paste.len, 2);
+    ASSERT_EQ(memcmp(ev.data.paste.text, "hi", 2), 0);
+    close(fd);
+}
+
+TEST(terminal_repeats_fold_into_one_event) {
+    static const char input[] = "jjjjx\x1b[B\x1b[B\x1b[B\x1b[Aqq";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    EditorEvent ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, 'j');
+    ASSERT_EQ(event_repeat(&ev), 4);
+    /* The key read past them comes next */
+    ASSERT_TRUE(terminal_input_pending(fd));
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, 'x');
+    ASSERT_EQ(event_repeat(&ev), 1);
+
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, ARROW_DOWN);
+    ASSERT_EQ(event_repeat(&ev), 3);
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, ARROW_UP);
+    ASSERT_EQ(event_repeat(&ev), 1);
+
+    /* Only motions fold */
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, 'q');
+    ASSERT_EQ(event_repeat(&ev), 1);
+    ASSERT_EQ(terminal_read_key(fd), 'q');
+    ASSERT_FALSE(terminal_input_pending(fd));
+    close(fd);
+}
+
+TEST(terminal_read_key_mouse_reports) {
+    static const char input[] = "\x1b[<0;12;5M\x1b[<2;1;1m\x1b[<66;3;3M\x1b[<1;2Mz";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    ASSERT_EQ(terminal_read_key(fd), MOUSE_KEY);
+    const TermMouse *m = terminal_mouse();
+    ASSERT_EQ(m->button, 0);
+    ASSERT_EQ(m->x, 12);
+    ASSERT_EQ(m->y, 5);
+    ASSERT_FALSE(m->release);
+    ASSERT_EQ(terminal_read_key(fd), MOUSE_KEY);
+    ASSERT_EQ(m->button, 2);
+    ASSERT_TRUE(m->release);
+
+    /* A horizontal wheel turn is read, and no event */
+    EditorEvent ev = event_from_keycode(terminal_read_key(fd));
+    ASSERT_EQ(ev.type, EVENT_NONE);
+    /* Not three numbers: skipped */
+    ASSERT_EQ(terminal_read_key(fd), 'z');
+    close(fd);
+}
+
+TEST(terminal_mouse_bursts_fold_into_one_event) {
+    static const char input[] =
+        "\x1b[<65;5;5M\x1b[<65;5;6M\x1b[<64;5;6M\x1b[<65;5;7M"  /* Wheel: 2 down */
+        "\x1b[<0;3;4M\x1b[<32;4;4M\x1b[<32;9;6M\x1b[<0;9;6m"    /* Press, drags, release */
+        "\x1b[<64;1;1Mq";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    EditorEvent ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.type, EVENT_MOUSE);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_WHEEL);
+    ASSERT_EQ(ev.data.mouse.wheel, 2);
+    ASSERT_EQ(ev.data.mouse.y, 7);
+
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_PRESS);
+    ASSERT_EQ(ev.data.mouse.x, 3);
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_DRAG);
+    ASSERT_EQ(ev.data.mouse.button, 0);
+    ASSERT_EQ(ev.data.mouse.x, 9);
+    ASSERT_EQ(ev.data.mouse.y, 6);
+    /* The report read past the drags comes next */
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_RELEASE);
+    ASSERT_FALSE(ev.data.mouse.pressed);
+
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.mouse.wheel, -1);
+    ev = event_read_terminal(fd);
+    ASSERT_EQ(ev.data.key.keycode, 'q');
+    close(fd);
+}
+
+TEST(terminal_recorded_keys_replay) {
+    static const char input[] = "i\x1b[A\x1b[200~a\r\nb\x1b[201~\x1b[<32;7;2M\x1b[<0;7;2m\x1b";
+    const char *trace = "/tmp/loki_test_key_trace";
+    int fd = input_pipe(input, sizeof(input) - 1);
+
+    ASSERT_EQ(terminal_record_keys(trace), 0);
+    ASSERT_EQ(terminal_read_key(fd), 'i');
+    ASSERT_EQ(terminal_read_key(fd), ARROW_UP);
+    ASSERT_EQ(terminal_read_key(fd), PASTE_KEY);
+    ASSERT_EQ(terminal_read_key(fd), MOUSE_KEY);
+    ASSERT_EQ(terminal_read_key(fd), MOUSE_KEY);
+    ASSERT_EQ(terminal_read_key(fd), ESC);
+    ASSERT_EQ(terminal_record_keys(NULL), 0);
+    close(fd);
+
+    EventSource *src = event_source_replay(trace);
+    ASSERT_NOT_NULL(src);
+    EditorEvent ev = src->read(src, 0);
+    ASSERT_EQ(ev.data.key.keycode, 'i');
+    ev = src->read(src, 0);
+    ASSERT_EQ(ev.data.key.keycode, ARROW_UP);
+    ev = src->read(src, 0);
+    ASSERT_EQ(ev.type, EVENT_PASTE);
+    ASSERT_EQ((int)ev.data.paste.len, 3);
+    ASSERT_EQ(memcmp(ev.data.paste.text, "a\nb", 3), 0);
+    ev = src->read(src, 0);
+    ASSERT_EQ(ev.type, EVENT_MOUSE);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_DRAG);
+    ASSERT_EQ(ev.data.mouse.x, 7);
+    ev = src->read(src, 0);
+    ASSERT_EQ(ev.data.mouse.kind, MOUSE_RELEASE);
+    ev = src->read(src, 0);
+    ASSERT_EQ(ev.data.key.keycode, ESC);
+    ASSERT_FALSE(src->poll(src));
+    ASSERT_EQ(src->read(src, 0).type, EVENT_NONE);
+    src->destroy(src);
+
+    /* Not a trace */
+    FILE *fp = fopen(trace, "w");
+    fprintf(fp, "12\npaste 99\nshort\n");
+    fclose(fp);
+    ASSERT_NULL(event_source_replay(trace));
+    remove(trace);
+}
+
 BEGIN_TEST_SUITE("Terminal Buffer Operations")
     /* Basic buffer operations */
     RUN_TEST(terminal_buffer_init);
@@ -340,4 +569,15 @@ BEGIN_TEST_SUITE("Terminal Buffer Operations")
     RUN_TEST(terminal_buffer_free_null_safe);
     RUN_TEST(terminal_buffer_append_after_free);
     RUN_TEST(terminal_buffer_newlines);
+
+    /* Key reading */
+    RUN_TEST(terminal_read_key_parses_sequences);
+    RUN_TEST(terminal_read_key_lone_escape);
+    RUN_TEST(terminal_read_key_bracketed_paste);
+    RUN_TEST(terminal_read_key_paste_across_reads);
+    RUN_TEST(terminal_paste_becomes_one_event);
+    RUN_TEST(terminal_repeats_fold_into_one_event);
+    RUN_TEST(terminal_read_key_mouse_reports);
+    RUN_TEST(terminal_mouse_bursts_fold_into_one_event);
+    RUN_TEST(terminal_recorded_keys_replay);
 END_TEST_SUITE()
@@ -0,0 +1,208 @@
+/* test_timer_wheel.c - Unit tests for the timer wheel
+ *
+ * Tests for:
+ * - Timers firing at their times, in order, on a fake clock
+ * - Cancelling, and ids staying dead once their entry is reused
+ * - Interval timers, and one-shots refused by their callback
+ * - Timers far enough out to move down every level
+ * - The time to the next timer, and many timers at once
+ * - The service delivering ASYNC_EVENT_TIMER events
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_framework.h"
+#include "timer_wheel.h"
+#include "async_queue.h"
+#include <time.h>
+
+static int fired_ids[64];
+static uint64_t fired_at[64];
+static int nfired;
+static uint64_t clock_ms;
+static int refuse;
+
+static int record_fire(int id, void *userdata, void *arg) {
+    (void)userdata;
+    (void)arg;
+    if (refuse > 0) {
+        refuse--;
+        return -1;
+    }
+    if (nfired < 64) {
+        fired_ids[nfired] = id;
+        fired_at[nfired] = clock_ms;
+    }
+    nfired++;
+    return 0;
+}
+
+/* Step the wheel a millisecond at a time, so fires record their time */
+static void run_to(TimerWheel *wheel, uint64_t to) {
+    while (clock_ms < to) {
+        clock_ms++;
+        timer_wheel_advance(wheel, clock_ms, record_fire, NULL);
+    }
+}
+
+static void reset(TimerWheel *wheel, uint64_t start) {
+    nfired = 0;
+    refuse = 0;
+    clock_ms = start;
+    timer_wheel_init(wheel, start);
+}
+
+TEST(timer_wheel_fires_in_order) {
+    TimerWheel wheel;
+    reset(&wheel, 1000);
+    int late = timer_wheel_add(&wheel, 1000, 30, 0, NULL);
+    int soon = timer_wheel_add(&wheel, 1000, 5, 0, NULL);
+    int mid = timer_wheel_add(&wheel, 1000, 20, 0, NULL);
+    ASSERT_TRUE(late > 0 && soon > 0 && mid > 0);
+    ASSERT_TRUE(timer_wheel_pending(&wheel, soon));
+
+    run_to(&wheel, 1100);
+    ASSERT_EQ(nfired, 3);
+    ASSERT_EQ(fired_ids[0], soon);
+    ASSERT_EQ((int)fired_at[0], 1005);
+    ASSERT_EQ(fired_ids[1], mid);
+    ASSERT_EQ((int)fired_at[1], 1020);
+    ASSERT_EQ(fired_ids[2], late);
+    ASSERT_EQ((int)fired_at[2], 1030);
+    ASSERT_FALSE(timer_wheel_pending(&wheel, soon));
+    ASSERT_EQ(timer_wheel_timeout(&wheel, 1100), -1);
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_wheel_cancel) {
+    TimerWheel wheel;
+    reset(&wheel, 0);
+    int a = timer_wheel_add(&wheel, 0, 10, 0, NULL);
+    int b = timer_wheel_add(&wheel, 0, 10, 0, NULL);
+    ASSERT_EQ(timer_wheel_cancel(&wheel, a), 0);
+    ASSERT_EQ(timer_wheel_cancel(&wheel, a), -1);
+    ASSERT_EQ(timer_wheel_cancel(&wheel, 0), -1);
+
+    /* The entry is reused under a new id; the old one stays dead */
+    int c = timer_wheel_add(&wheel, 0, 10, 0, NULL);
+    ASSERT_TRUE(c != a);
+    ASSERT_FALSE(timer_wheel_pending(&wheel, a));
+    ASSERT_EQ(timer_wheel_cancel(&wheel, a), -1);
+
+    run_to(&wheel, 20);
+    ASSERT_EQ(nfired, 2);
+    ASSERT_TRUE((fired_ids[0] == b && fired_ids[1] == c) ||
+                (fired_ids[0] == c && fired_ids[1] == b));
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_wheel_interval_and_retry) {
+    TimerWheel wheel;
+    reset(&wheel, 0);
+    int tick = timer_wheel_add(&wheel, 0, 10, 10, NULL);
+    run_to(&wheel, 35);
+    ASSERT_EQ(nfired, 3);
+    ASSERT_EQ((int)fired_at[2], 30);
+    ASSERT_TRUE(timer_wheel_pending(&wheel, tick));
+    ASSERT_EQ(timer_wheel_cancel(&wheel, tick), 0);
+
+    /* A one-shot its callback refuses fires again the next tick */
+    nfired = 0;
+    timer_wheel_add(&wheel, clock_ms, 5, 0, NULL);
+    refuse = 2;
+    run_to(&wheel, 50);
+    ASSERT_EQ(nfired, 1);
+    ASSERT_EQ((int)fired_at[0], 42);
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_wheel_far_timers_cascade) {
+    TimerWheel wheel;
+    reset(&wheel, 123);
+    /* One per level, and one past the top level's reach */
+    uint64_t delays[5] = { 50, 3000, 200000, 10000000, 20000000000ull };
+    int ids[5];
+    for (int i = 0; i < 5; i++) ids[i] = timer_wheel_add(&wheel, 123, delays[i], 0, NULL);
+
+    /* Jumping the clock fires each at its time, seen by the advance that
+     * covers it */
+    for (int i = 0; i < 5; i++) {
+        uint64_t due = 123 + delays[i];
+        ASSERT_EQ(timer_wheel_advance(&wheel, due - 1, record_fire, NULL), 0);
+        clock_ms = due;
+        ASSERT_EQ(timer_wheel_advance(&wheel, due, record_fire, NULL), 1);
+        ASSERT_EQ(fired_ids[i], ids[i]);
+    }
+    ASSERT_EQ(nfired, 5);
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_wheel_timeout) {
+    TimerWheel wheel;
+    reset(&wheel, 0);
+    ASSERT_EQ(timer_wheel_timeout(&wheel, 0), -1);
+    timer_wheel_add(&wheel, 0, 40, 0, NULL);
+    ASSERT_EQ(timer_wheel_timeout(&wheel, 0), 40);
+    ASSERT_EQ(timer_wheel_timeout(&wheel, 50), 0);
+
+    /* Further out: no later than the timer, maybe sooner to move it down */
+    timer_wheel_free(&wheel);
+    timer_wheel_add(&wheel, 0, 5000, 0, NULL);
+    int64_t t = timer_wheel_timeout(&wheel, 0);
+    ASSERT_TRUE(t > 0 && t <= 5000);
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_wheel_many_timers) {
+    TimerWheel wheel;
+    reset(&wheel, 0);
+    int ids[5000];
+    for (int i = 0; i < 5000; i++) {
+        ids[i] = timer_wheel_add(&wheel, 0, (uint64_t)(i % 997) * 7 + 1, 0, NULL);
+        ASSERT_TRUE(ids[i] > 0);
+    }
+    for (int i = 0; i < 5000; i += 2) ASSERT_EQ(timer_wheel_cancel(&wheel, ids[i]), 0);
+    ASSERT_EQ(wheel.active, 2500);
+
+    clock_ms = 10000;
+    ASSERT_EQ(timer_wheel_advance(&wheel, clock_ms, record_fire, NULL), 2500);
+    ASSERT_EQ(wheel.active, 0);
+    timer_wheel_free(&wheel);
+}
+
+TEST(timer_service_delivers_events) {
+    ASSERT_EQ(timer_service_add(1, 0, NULL), -1);   /* No queue */
+
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    int marker;
+    int id = timer_service_add(2, 0, &marker);
+    ASSERT_TRUE(id > 0);
+    ASSERT_TRUE(timer_service_pending(id));
+    ASSERT_TRUE(timer_service_timeout() >= 0);
+
+    struct timespec ts = {0, 5000000};
+    nanosleep(&ts, NULL);
+    timer_service_run();
+    ASSERT_FALSE(timer_service_pending(id));
+
+    AsyncEvent ev;
+    ASSERT_EQ(async_queue_poll(NULL, &ev), 0);
+    ASSERT_EQ(ev.type, ASYNC_EVENT_TIMER);
+    ASSERT_EQ(ev.data.timer.timer_id, id);
+    ASSERT_TRUE(ev.data.timer.userdata == &marker);
+    ASSERT_EQ(timer_service_timeout(), -1);
+
+    timer_service_cleanup();
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("Timer Wheel")
+    RUN_TEST(timer_wheel_fires_in_order);
+    RUN_TEST(timer_wheel_cancel);
+    RUN_TEST(timer_wheel_interval_and_retry);
+    RUN_TEST(timer_wheel_far_timers_cascade);
+    RUN_TEST(timer_wheel_timeout);
+    RUN_TEST(timer_wheel_many_timers);
+    RUN_TEST(timer_service_delivers_events);
+END_TEST_SUITE()
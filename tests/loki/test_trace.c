@@ -0,0 +1,139 @@
+/* test_trace.c - Unit tests for keystroke latency tracing
+ *
+ * Tests for:
+ * - Nothing traced, and no time taken, until a trace is started
+ * - Spans and inputs written as Chrome trace events, a JSON array
+ * - Every input read before a frame ended by that frame
+ * - Tracing started from LOKI_TRACE
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "trace.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_TRACE "/tmp/loki_test_trace.json"
+
+/* Helper: Parse the trace written to TEST_TRACE into 'doc' */
+static const JsonValue *read_trace(JsonDoc *doc) {
+    static char buf[65536];
+    FILE *fp = fopen(TEST_TRACE, "r");
+    if (!fp) return NULL;
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if (json_doc_parse(doc, buf, len) != 0 || doc->root.type != JSON_ARRAY) return NULL;
+    return &doc->root;
+}
+
+/* Helper: How many events of 'trace' are named 'name' with phase 'ph' */
+static int count_events(const JsonValue *trace, const char *name, const char *ph) {
+    int n = 0;
+    for (size_t i = 0; i < trace->data.array_val.count; i++) {
+        const JsonValue *ev = &trace->data.array_val.items[i];
+        const char *evname = json_object_get_string(ev, "name");
+        const char *evph = json_object_get_string(ev, "ph");
+        if (evname && evph && strcmp(evname, name) == 0 && strcmp(evph, ph) == 0) n++;
+    }
+    return n;
+}
+
+TEST(trace_off_does_nothing) {
+    ASSERT_FALSE(trace_active());
+    ASSERT_EQ(trace_begin(), 0);
+    EditorEvent ev = event_key('j', MOD_NONE);
+    trace_input(&ev, 1);
+    trace_end("modal_process_event", 0);
+    trace_frame_shown();
+    ASSERT_FALSE(trace_active());
+}
+
+TEST(trace_writes_chrome_events) {
+    ASSERT_EQ(trace_start(TEST_TRACE), 0);
+    ASSERT_TRUE(trace_active());
+
+    EditorEvent ev = event_key('j', MOD_NONE);
+    ev.data.key.repeat = 3;
+    trace_input(&ev, trace_begin());
+    EditorEvent paste = event_paste("abc", 3);
+    trace_input(&paste, trace_begin());
+
+    uint64_t span = trace_begin();
+    ASSERT_TRUE(span > 0);
+    trace_end("modal_process_event", span);
+    trace_frame_shown();
+    /* Nothing read since: nothing more ends */
+    trace_frame_shown();
+    trace_stop();
+    ASSERT_FALSE(trace_active());
+
+    JsonDoc doc;
+    const JsonValue *trace = read_trace(&doc);
+    ASSERT_NOT_NULL(trace);
+    ASSERT_EQ(count_events(trace, "process_name", "M"), 1);
+    ASSERT_EQ(count_events(trace, "input", "b"), 2);
+    ASSERT_EQ(count_events(trace, "input", "e"), 2);
+    ASSERT_EQ(count_events(trace, "modal_process_event", "X"), 1);
+
+    /* The key's details, and its span ended under the same id */
+    const JsonValue *begin = &trace->data.array_val.items[1];
+    const JsonValue *args = json_object_get(begin, "args");
+    ASSERT_EQ(json_object_get_int(args, "key", 0), 'j');
+    ASSERT_EQ(json_object_get_int(args, "repeat", 0), 3);
+    ASSERT_EQ(json_object_get_int(json_object_get(&trace->data.array_val.items[2], "args"),
+                                  "paste", 0), 3);
+    const JsonValue *end = &trace->data.array_val.items[4];
+    ASSERT_STR_EQ(json_object_get_string(end, "ph"), "e");
+    ASSERT_EQ(json_object_get_int(end, "id", -1), json_object_get_int(begin, "id", -2));
+    ASSERT_TRUE(json_object_get_int(end, "ts", 0) >= json_object_get_int(begin, "ts", 0));
+    json_doc_free(&doc);
+    remove(TEST_TRACE);
+}
+
+TEST(trace_follows_an_edit) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+
+    ASSERT_EQ(trace_start(TEST_TRACE), 0);
+    EditorEvent ev = event_key('i', MOD_NONE);
+    trace_input(&ev, trace_begin());
+    modal_process_event(&ctx, &ev);
+    trace_frame_shown();
+    trace_stop();
+
+    JsonDoc doc;
+    const JsonValue *trace = read_trace(&doc);
+    ASSERT_NOT_NULL(trace);
+    ASSERT_EQ(count_events(trace, "modal_process_event", "X"), 1);
+    ASSERT_EQ(count_events(trace, "input", "e"), 1);
+    json_doc_free(&doc);
+    remove(TEST_TRACE);
+    editor_ctx_free(&ctx);
+}
+
+TEST(trace_starts_from_env) {
+    setenv(TRACE_ENV, TEST_TRACE, 1);
+    trace_start_from_env();
+    ASSERT_TRUE(trace_active());
+    trace_stop();
+    unsetenv(TRACE_ENV);
+    trace_start_from_env();
+    ASSERT_FALSE(trace_active());
+
+    JsonDoc doc;
+    ASSERT_NOT_NULL(read_trace(&doc));
+    json_doc_free(&doc);
+    remove(TEST_TRACE);
+}
+
+BEGIN_TEST_SUITE("Latency Tracing")
+    RUN_TEST(trace_off_does_nothing);
+    RUN_TEST(trace_writes_chrome_events);
+    RUN_TEST(trace_follows_an_edit);
+    RUN_TEST(trace_starts_from_env);
+END_TEST_SUITE()
@@ -6,15 +6,24 @@
  * - Line operations undo
  * - Undo grouping heuristics
  * - Redo after undo
- * - Memory and capacity limits
+ * - Text runs of typed and deleted characters
+ * - Ranges replaced in one edit, across lines
+ * - The undo tree: branches, moving by number, step and time, limits
+ * - Bulk row edits sharing their contents with the buffer
+ * - Memory and capacity limits, and packing old groups to stay within them
  */
 
 #include "test_framework.h"
 #include "loki/core.h"
 #include "internal.h"
 #include "undo.h"
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+
+/* Row editing function from core.c (declared locally, as in undo.c) */
+void editor_row_del_char(editor_ctx_t *ctx, t_erow *row, int at);
 
 /* Helper: Create simple test context with undo enabled */
 static void init_ctx_with_undo(editor_ctx_t *ctx, const char *text) {
@@ -26,8 +35,7 @@ static void init_ctx_with_undo(editor_ctx_t *ctx, const char *text) {
     ctx->model.row[0].size = strlen(text);
     ctx->model.row[0].render = strdup(text);
     ctx->model.row[0].rsize = strlen(text);
-    ctx->model.row[0].hl = NULL;
-    ctx->model.row[0].idx = 0;
+    ctx->model.row[0].hl_buf.hl = NULL;
 
     ctx->view.screenrows = 24;
     ctx->view.screencols = 80;
@@ -48,8 +56,7 @@ static void init_multiline_ctx_with_undo(editor_ctx_t *ctx, int num_lines, const
         ctx->model.row[i].size = strlen(lines[i]);
         ctx->model.row[i].render = strdup(lines[i]);
         ctx->model.row[i].rsize = strlen(lines[i]);
-        ctx->model.row[i].hl = NULL;
-        ctx->model.row[i].idx = i;
+        ctx->model.row[i].hl_buf.hl = NULL;
     }
 
     ctx->view.screenrows = 24;
@@ -265,7 +272,8 @@ TEST(undo_groups_consecutive_inserts) {
     int undo_levels, redo_levels;
     size_t memory;
     undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
-    ASSERT_EQ(undo_levels, 4);  /* 4 operations recorded */
+    ASSERT_EQ(undo_levels, 1);  /* One text run of 4 characters */
+    ASSERT_EQ((int)memory, 4);
 
     /* But they should all be in the same group */
     /* Single undo should undo the entire group */
@@ -355,6 +363,589 @@ TEST(undo_breaks_on_row_change) {
     cleanup_ctx(&ctx);
 }
 
+/* ============================================================================
+ * Text Run Tests
+ * ============================================================================ */
+
+TEST(undo_typed_text_is_one_run) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "ab");
+    ctx.view.cx = 1;
+
+    /* A 1000 character paste between 'a' and 'b' */
+    for (int i = 0; i < 1000; i++) editor_insert_char(&ctx, 'a' + i % 26);
+    ASSERT_EQ(ctx.model.row[0].size, 1002);
+
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ASSERT_EQ((int)memory, 1000);
+
+    /* Undone and redone as a whole, the cursor back where typing began */
+    unsigned long dirty = ctx.model.dirty;
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ab");
+    ASSERT_EQ(ctx.view.cx, 1);
+    ASSERT_EQ(ctx.model.dirty - dirty, 2);     /* One row rewrite */
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.row[0].size, 1002);
+    ASSERT_EQ(ctx.model.row[0].chars[1], 'a');
+    ASSERT_EQ(ctx.model.row[0].chars[1000], 'l');
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_deleted_text_is_one_run) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "hello world");
+
+    /* Backspace over "world" */
+    ctx.view.cx = 11;
+    for (int i = 0; i < 5; i++) editor_del_char(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hello ");
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+
+    undo_perform(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hello world");
+    redo_perform(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hello ");
+    undo_perform(&ctx);
+
+    /* Deleting forward at one column extends a run the other way */
+    undo_break_group(&ctx);
+    undo_record_delete_char(&ctx, 0, 0, 'h');
+    undo_record_delete_char(&ctx, 0, 0, 'e');
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    memmove(ctx.model.row[0].chars, ctx.model.row[0].chars + 2, 10);
+    ctx.model.row[0].size = 9;
+    undo_perform(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "hello world");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_runs_stop_at_gaps_and_redo_history) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "abcdef");
+
+    /* Two columns on: same group, but a run of its own */
+    undo_record_insert_char(&ctx, 0, 1, 'x');
+    undo_record_insert_char(&ctx, 0, 3, 'y');
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 2);
+
+    /* After an undo, typing starts a new run instead of reviving it (on
+     * a branch of its own: the undone one is kept) */
+    undo_perform(&ctx);
+    undo_record_insert_char(&ctx, 0, 1, 'z');
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ASSERT_EQ(redo_levels, 0);
+    ASSERT_EQ((int)memory, 3);
+
+    cleanup_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Range Tests
+ * ============================================================================ */
+
+/* The rows of 'ctx' joined by newlines, in 'buf' */
+static const char *buffer_text(editor_ctx_t *ctx, char *buf, size_t size) {
+    size_t n = 0;
+    for (int i = 0; i < ctx->model.numrows; i++)
+        n += (size_t)snprintf(buf + n, size - n, i ? "\n%s" : "%s",
+                              ctx->model.row[i].chars);
+    return buf;
+}
+
+TEST(undo_line_splits_and_joins_restore_the_rows) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"one", "two"};
+    init_multiline_ctx_with_undo(&ctx, 2, lines);
+    char buf[256];
+
+    /* Split in the middle, at the start, and join */
+    ctx.view.cy = 1;
+    ctx.view.cx = 1;
+    editor_insert_newline(&ctx);
+    undo_break_group(&ctx);
+    ctx.view.cy = 0;
+    ctx.view.cx = 0;
+    editor_insert_newline(&ctx);
+    undo_break_group(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "\none\nt\nwo");
+    ctx.view.cy = 3;
+    ctx.view.cx = 0;
+    editor_del_char(&ctx);
+    undo_break_group(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "\none\ntwo");
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "\none\nt\nwo");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "one\nt\nwo");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "one\ntwo");
+
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "\none\ntwo");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_range_replaces_lines_as_one_entry) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"one", "two", "three"};
+    init_multiline_ctx_with_undo(&ctx, 3, lines);
+    char buf[256];
+
+    int row, col;
+    int removed = editor_replace_range(&ctx, 0, 1, 2, 2, "X\nY\nZ\nW", 7,
+                                       &row, &col);
+    ASSERT_EQ(removed, 9);                      /* "ne\ntwo\nth" */
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "oX\nY\nZ\nWree");
+    ASSERT_EQ(row, 3);
+    ASSERT_EQ(col, 1);
+
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ASSERT_EQ((int)memory, 16);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "one\ntwo\nthree");
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "oX\nY\nZ\nWree");
+
+    /* Fewer lines than it replaces, the ends given backwards */
+    removed = editor_replace_range(&ctx, 3, 2, 0, 1, "-", 1, &row, &col);
+    ASSERT_EQ(removed, 8);                      /* "X\nY\nZ\nWr" */
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "o-ee");
+    ASSERT_EQ(col, 2);
+    undo_perform(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "oX\nY\nZ\nWree");
+    undo_perform(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "one\ntwo\nthree");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_range_clamps_and_stays_out_of_runs) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "ab");
+    char buf[256];
+
+    /* Past the end of the document is its end */
+    int row, col;
+    editor_replace_range(&ctx, 5, 0, 9, 9, "c\n", 2, &row, &col);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "abc\n");
+    ASSERT_EQ(row, 1);
+    ASSERT_EQ(col, 0);
+
+    /* Typing right after the range starts an entry of its own */
+    ctx.view.cy = 1;
+    ctx.view.cx = 0;
+    editor_insert_char(&ctx, 'd');
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 2);
+    undo_perform(&ctx);
+    undo_perform(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "ab");
+
+    /* Nothing to replace and nothing to put is no edit */
+    ASSERT_EQ(editor_replace_range(&ctx, 0, 1, 0, 1, "", 0, NULL, NULL), 0);
+    ASSERT_FALSE(undo_can_undo(&ctx));
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_insert_text_is_one_entry) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"hello", "world"};
+    init_multiline_ctx_with_undo(&ctx, 2, lines);
+    ctx.view.screenrows = 2;
+    ctx.view.screencols = 80;
+    ctx.view.cx = 2;
+    char buf[256];
+
+    /* Split at the cursor, which ends up after the text, scrolled to */
+    editor_insert_text(&ctx, "AB\nCD\nE", 7);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "heAB\nCD\nEllo\nworld");
+    ASSERT_EQ(ctx.view.rowoff + ctx.view.cy, 2);
+    ASSERT_EQ(ctx.view.cy, 1);
+    ASSERT_EQ(ctx.view.cx, 1);
+
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "hello\nworld");
+
+    cleanup_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Undo Tree Tests
+ * ============================================================================ */
+
+/* Type 'c' at the end of row 0, as a group of its own */
+static void type_group(editor_ctx_t *ctx, char c) {
+    ctx->view.cy = ctx->view.rowoff = 0;
+    ctx->view.cx = ctx->model.row[0].size;
+    ctx->view.coloff = 0;
+    undo_break_group(ctx);
+    editor_insert_char(ctx, c);
+    undo_break_group(ctx);
+}
+
+TEST(undo_tree_keeps_undone_branches) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+
+    type_group(&ctx, 'a');                  /* 1 */
+    type_group(&ctx, 'b');                  /* 2 */
+    undo_perform(&ctx);
+    type_group(&ctx, 'c');                  /* 3, a branch from 1 */
+    int newest;
+    ASSERT_EQ(undo_state_seq(&ctx, &newest), 3);
+    ASSERT_EQ(newest, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+
+    /* Over to the other branch and back, through their common state */
+    ASSERT_EQ(undo_goto(&ctx, 2), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ab");
+    ASSERT_EQ(undo_goto(&ctx, 2), 0);
+    ASSERT_EQ(undo_goto(&ctx, 3), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+    ASSERT_EQ(undo_goto(&ctx, 0), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    ASSERT_EQ(undo_goto(&ctx, 4), -1);
+
+    /* Redo follows the branch last left */
+    redo_perform(&ctx);
+    redo_perform(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+    ASSERT_FALSE(undo_can_redo(&ctx));
+    undo_perform(&ctx);
+    undo_goto(&ctx, 2);
+    undo_perform(&ctx);
+    redo_perform(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ab");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_step_and_time_go_in_the_order_made) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+
+    type_group(&ctx, 'a');
+    type_group(&ctx, 'b');
+    undo_perform(&ctx);
+    type_group(&ctx, 'c');
+
+    /* 3 -> 2 crosses to the other branch */
+    ASSERT_EQ(undo_step(&ctx, -1), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ab");
+    undo_step(&ctx, -1);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 1);
+    ASSERT_EQ(undo_step(&ctx, -5), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    ASSERT_EQ(undo_step(&ctx, -1), 0);
+    ASSERT_EQ(undo_step(&ctx, 9), 1);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 3);
+    ASSERT_EQ(undo_step(&ctx, 1), 0);
+
+    /* Before every group is the original text; now is the newest */
+    ASSERT_EQ(undo_goto_time(&ctx, 0), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    ASSERT_EQ(undo_state_time(&ctx), 0);
+    ASSERT_EQ(undo_goto_time(&ctx, time(NULL)), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "ac");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_tree_drops_oldest_groups_within_limits) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+    undo_free(&ctx);
+    undo_init(&ctx, 5, 1024 * 1024);
+
+    /* Enough groups, and branches, for the arrays to be compacted */
+    for (int i = 0; i < 1000; i++) {
+        type_group(&ctx, 'a' + i % 26);
+        if (i % 10 == 4) {
+            undo_perform(&ctx);
+            type_group(&ctx, '-');
+            undo_perform(&ctx);
+            redo_perform(&ctx);
+        }
+    }
+    int undo_levels, redo_levels;
+    size_t memory;
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 5);
+    ASSERT_EQ((int)memory, 5);
+    ASSERT_EQ(undo_goto(&ctx, 1), -1);
+
+    /* The oldest state kept is as the text was five groups back */
+    int seq = undo_state_seq(&ctx, NULL);
+    char before[1200];
+    snprintf(before, sizeof(before), "%.*s", ctx.model.row[0].size - 5,
+             ctx.model.row[0].chars);
+    while (undo_perform(&ctx)) {}
+    ASSERT_STR_EQ(ctx.model.row[0].chars, before);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), seq - 5);
+    ASSERT_EQ(undo_goto(&ctx, seq), 1);
+
+    /* The memory limit drops groups too, but not the one being typed */
+    undo_free(&ctx);
+    undo_init(&ctx, 100, 8);
+    for (int i = 0; i < 6; i++) type_group(&ctx, 'x');
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ctx.view.cx = ctx.model.row[0].size;
+    for (int i = 0; i < 20; i++) editor_insert_char(&ctx, 'y');
+    undo_get_stats(&ctx, &undo_levels, &redo_levels, &memory);
+    ASSERT_EQ(undo_levels, 1);
+    ASSERT_EQ((int)memory, 20);
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_counts_everything_it_holds) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+    undo_memory_stats_t st;
+
+    /* One character typed costs its group, its entry and its text block */
+    editor_insert_char(&ctx, 'a');
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ(st.groups, 1);
+    ASSERT_EQ(st.entries, 1);
+    ASSERT_EQ((int)st.text, 1);
+    ASSERT_TRUE(st.total > sizeof(undo_entry_t));
+    size_t one = st.total;
+
+    /* A run growing past its block grows the count by the new block */
+    for (int i = 0; i < 40; i++) editor_insert_char(&ctx, 'b');
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ(st.entries, 1);
+    ASSERT_EQ((int)st.text, 41);
+    ASSERT_TRUE(st.total >= one + 40);
+
+    /* Everything goes back to nothing */
+    undo_clear(&ctx);
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ((int)st.total, 0);
+    ASSERT_EQ((int)st.text, 0);
+
+    cleanup_ctx(&ctx);
+}
+
+/* A packed group that doesn't decode fails that undo, not the editor */
+TEST(undo_unreadable_pack_fails_only_that_undo) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+    undo_free(&ctx);
+    undo_init(&ctx, 100, 2048);
+    char line[80];
+    snprintf(line, sizeof(line), "%s", "the quick brown fox jumps over it");
+    int len = (int)strlen(line);
+    for (int i = 0; i < 40; i++) {
+        int row, col;
+        editor_replace_range(&ctx, 0, 0, 0, ctx.model.row[0].size, line, len,
+                             &row, &col);
+        line[i % len] = (char)('A' + i % 26);
+    }
+    undo_memory_stats_t st;
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_TRUE(st.packed_groups > 0);
+    undo_damage_packs(&ctx);
+
+    /* Undo goes back to the first packed group, and stops there */
+    int moved, undone = 0;
+    while ((moved = undo_perform(&ctx)) == 1) undone++;
+    ASSERT_EQ(moved, -2);
+    ASSERT_EQ(undone, st.groups - st.packed_groups);
+    ASSERT_NOT_NULL(strstr(ctx.view.statusmsg, "corrupted"));
+    char at[80];
+    snprintf(at, sizeof(at), "%s", ctx.model.row[0].chars);
+    ASSERT_EQ(undo_perform(&ctx), -2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, at);
+
+    /* Going through it fails the same way; redo and edits still work */
+    ASSERT_EQ(undo_step(&ctx, -100), -2);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, at);
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    type_group(&ctx, 'z');
+    ASSERT_EQ(undo_perform(&ctx), 1);
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_packs_old_groups_before_dropping_them) {
+    editor_ctx_t ctx;
+    init_ctx_with_undo(&ctx, "");
+    undo_memory_stats_t st;
+    char line[80];
+    snprintf(line, sizeof(line), "%s", "the quick brown fox jumps over it");
+    int len = (int)strlen(line);
+
+    /* What forty groups of a line each cost unpacked */
+    for (int i = 0; i < 40; i++) {
+        int row, col;
+        editor_replace_range(&ctx, 0, 0, 0, ctx.model.row[0].size, line, len,
+                             &row, &col);
+        line[i % len] = (char)('A' + i % 26);
+    }
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ(st.groups, 40);
+    ASSERT_EQ(st.packed_groups, 0);
+    size_t full = st.total;
+    char newest[80];
+    snprintf(newest, sizeof(newest), "%s", ctx.model.row[0].chars);
+
+    /* Under a limit a tenth lower, old groups are packed and none
+     * dropped */
+    undo_free(&ctx);
+    undo_init(&ctx, 100, full * 9 / 10);
+    editor_row_set(&ctx, &ctx.model.row[0], "", 0);
+    snprintf(line, sizeof(line), "%s", "the quick brown fox jumps over it");
+    for (int i = 0; i < 40; i++) {
+        int row, col;
+        editor_replace_range(&ctx, 0, 0, 0, ctx.model.row[0].size, line, len,
+                             &row, &col);
+        line[i % len] = (char)('A' + i % 26);
+    }
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ(st.groups, 40);
+    ASSERT_TRUE(st.packed_groups > 0);
+    ASSERT_TRUE(st.total <= st.limit);
+    ASSERT_TRUE(st.packed > 0);
+    ASSERT_EQ((int)st.text, 40 * len + 39 * len);
+
+    /* Undo unpacks them on the way back, and redo replays them */
+    while (undo_perform(&ctx)) {}
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    while (redo_perform(&ctx)) {}
+    ASSERT_STR_EQ(ctx.model.row[0].chars, newest);
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ((int)st.text, 40 * len + 39 * len);
+
+    /* The next edit packs them again; one too many for the limit drops
+     * the oldest */
+    type_group(&ctx, 'z');
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_TRUE(st.packed_groups > 0);
+    ASSERT_TRUE(st.total <= st.limit);
+
+    undo_free(&ctx);
+    undo_init(&ctx, 100, full / 8);
+    for (int i = 0; i < 40; i++) {
+        int row, col;
+        editor_replace_range(&ctx, 0, 0, 0, ctx.model.row[0].size, line, len,
+                             &row, &col);
+    }
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_TRUE(st.groups < 40);
+    ASSERT_TRUE(st.total <= st.limit);
+
+    cleanup_ctx(&ctx);
+}
+
+/* ============================================================================
+ * Shared Row Tests
+ * ============================================================================ */
+
+TEST(undo_rows_share_contents_with_the_buffer) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"alpha", "beta", "gamma"};
+    init_multiline_ctx_with_undo(&ctx, 3, lines);
+    char buf[256];
+
+    undo_rows_t rows = {0};
+    undo_rows_set(&rows, &ctx, 0, "ALPHA", 5);
+    undo_rows_set(&rows, &ctx, 2, "G", 1);
+    undo_record_replace_rows(&ctx, &rows);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "ALPHA\nbeta\nG");
+    ASSERT_NOT_NULL(ctx.model.row[0].share);
+    ASSERT_NULL(ctx.model.row[1].share);
+
+    /* The new contents are the buffer's too; the old only the history's */
+    size_t memory;
+    undo_memory_stats_t st;
+    undo_get_stats(&ctx, NULL, NULL, &memory);
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ((int)memory, 16);
+    ASSERT_EQ((int)st.text, 16);
+    ASSERT_EQ((int)st.shared, 6);
+    ASSERT_TRUE(st.total > st.text);        /* The entry and its lists */
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "alpha\nbeta\ngamma");
+    undo_get_memory_stats(&ctx, &st);
+    ASSERT_EQ((int)st.shared, 10);
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "ALPHA\nbeta\nG");
+
+    cleanup_ctx(&ctx);
+}
+
+TEST(undo_shared_rows_are_copied_on_write) {
+    editor_ctx_t ctx;
+    const char *lines[] = {"alpha", "beta"};
+    init_multiline_ctx_with_undo(&ctx, 2, lines);
+    char buf[256];
+
+    undo_rows_t rows = {0};
+    undo_rows_set(&rows, &ctx, 0, "ALPHA", 5);
+    undo_rows_set(&rows, &ctx, 1, "BETA", 4);
+    undo_record_replace_rows(&ctx, &rows);
+
+    /* Typing into and deleting from shared rows leaves the history be */
+    ctx.view.cy = 0;
+    ctx.view.cx = 0;
+    editor_insert_char(&ctx, 'x');
+    undo_break_group(&ctx);
+    ctx.view.cy = 1;
+    ctx.view.cx = 1;
+    editor_del_char(&ctx);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "xALPHA\nETA");
+    ASSERT_NULL(ctx.model.row[0].share);
+    ASSERT_NULL(ctx.model.row[1].share);
+
+    ASSERT_EQ(undo_goto(&ctx, 1), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "ALPHA\nBETA");
+    ASSERT_EQ(undo_goto(&ctx, 0), 1);
+    ASSERT_STR_EQ(buffer_text(&ctx, buf, sizeof(buf)), "alpha\nbeta");
+
+    /* Contents no one else holds go back to the row */
+    undo_clear(&ctx);
+    ASSERT_NOT_NULL(ctx.model.row[0].share);
+    ASSERT_EQ(ctx.model.row[0].share->refs, 1);
+    editor_row_del_char(&ctx, &ctx.model.row[0], 0);
+    ASSERT_NULL(ctx.model.row[0].share);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "lpha");
+
+    cleanup_ctx(&ctx);
+}
+
 /* ============================================================================
  * Line Operations Tests
  * ============================================================================ */
@@ -422,7 +1013,7 @@ TEST(undo_respects_capacity_limit) {
     ctx.model.row[0].size = 4;
     ctx.model.row[0].render = strdup("test");
     ctx.model.row[0].rsize = 4;
-    ctx.model.row[0].hl = NULL;
+    ctx.model.row[0].hl_buf.hl = NULL;
 
     ctx.view.screenrows = 24;
     ctx.view.screencols = 80;
@@ -547,6 +1138,29 @@ BEGIN_TEST_SUITE("Undo/Redo System")
     RUN_TEST(undo_breaks_on_operation_type_change);
     RUN_TEST(undo_breaks_on_row_change);
 
+    /* Text runs */
+    RUN_TEST(undo_typed_text_is_one_run);
+    RUN_TEST(undo_deleted_text_is_one_run);
+    RUN_TEST(undo_runs_stop_at_gaps_and_redo_history);
+
+    /* Ranges */
+    RUN_TEST(undo_line_splits_and_joins_restore_the_rows);
+    RUN_TEST(undo_range_replaces_lines_as_one_entry);
+    RUN_TEST(undo_insert_text_is_one_entry);
+    RUN_TEST(undo_range_clamps_and_stays_out_of_runs);
+
+    /* Undo tree */
+    RUN_TEST(undo_tree_keeps_undone_branches);
+    RUN_TEST(undo_step_and_time_go_in_the_order_made);
+    RUN_TEST(undo_tree_drops_oldest_groups_within_limits);
+    RUN_TEST(undo_counts_everything_it_holds);
+    RUN_TEST(undo_packs_old_groups_before_dropping_them);
+    RUN_TEST(undo_unreadable_pack_fails_only_that_undo);
+
+    /* Shared rows */
+    RUN_TEST(undo_rows_share_contents_with_the_buffer);
+    RUN_TEST(undo_shared_rows_are_copied_on_write);
+
     /* Line operations */
     RUN_TEST(undo_record_insert_line_makes_undoable);
     RUN_TEST(undo_record_delete_line_makes_undoable);
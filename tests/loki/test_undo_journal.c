@@ -0,0 +1,352 @@
+/* test_undo_journal.c - Unit tests for undo history kept on disk
+ *
+ * Tests for:
+ * - History surviving a reopen, read back on the first undo
+ * - No journal until the first edit
+ * - The branch that was saved, and edits never saved
+ * - Files changed elsewhere, and persistence turned off
+ * - Records cut short or corrupted
+ * - The undo limits when the history is read back
+ */
+
+#include "test_framework.h"
+#include "loki/core.h"
+#include "internal.h"
+#include "undo.h"
+#include "undo_journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TEST_DIR "/tmp/loki_undo_journal_test"
+#define TEST_FILE TEST_DIR "/doc.txt"
+#define TEST_JOURNALS TEST_DIR "/undo"
+
+static void setup(const char *content) {
+    system("rm -rf " TEST_DIR);
+    mkdir(TEST_DIR, 0755);
+    undo_journal_set_dir(TEST_JOURNALS);
+    FILE *f = fopen(TEST_FILE, "w");
+    if (f) {
+        fputs(content, f);
+        fclose(f);
+    }
+}
+
+static void teardown(void) {
+    undo_journal_set_dir(NULL);
+    system("rm -rf " TEST_DIR);
+}
+
+static void open_doc(editor_ctx_t *ctx) {
+    editor_ctx_init(ctx);
+    editor_open(ctx, TEST_FILE);
+}
+
+/* Path of the one journal in TEST_JOURNALS ("" if there is none) */
+static void journal_path(char *path, size_t size) {
+    path[0] = '\0';
+    DIR *d = opendir(TEST_JOURNALS);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (strstr(e->d_name, ".undo"))
+            snprintf(path, size, "%s/%s", TEST_JOURNALS, e->d_name);
+    closedir(d);
+}
+
+static long journal_size(void) {
+    char path[512];
+    struct stat st;
+    journal_path(path, sizeof(path));
+    return path[0] && stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* Type 'c' at the end of the first row, as a group of its own */
+static void type_group(editor_ctx_t *ctx, char c) {
+    ctx->view.cy = ctx->view.rowoff = 0;
+    ctx->view.cx = ctx->model.row[0].size;
+    ctx->view.coloff = 0;
+    undo_break_group(ctx);
+    editor_insert_char(ctx, c);
+    undo_break_group(ctx);
+}
+
+/* ============================================================================
+ * Reopening
+ * ============================================================================ */
+
+TEST(undo_history_survives_reopening) {
+    setup("one\ntwo\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    type_group(&ctx, 'b');
+    ctx.view.cy = 1;
+    ctx.view.cx = 0;
+    editor_insert_newline(&ctx);
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+
+    open_doc(&ctx);
+    ASSERT_EQ(ctx.model.numrows, 3);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneab");
+    int newest, levels;
+    size_t memory;
+    ASSERT_EQ(undo_state_seq(&ctx, &newest), 3);
+    ASSERT_EQ(newest, 3);
+    ASSERT_TRUE(undo_can_undo(&ctx));
+
+    /* Nothing is read until it is needed */
+    undo_get_stats(&ctx, &levels, NULL, &memory);
+    ASSERT_EQ(levels, 0);
+    ASSERT_EQ(memory, 0);
+
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(ctx.model.numrows, 2);
+    ASSERT_TRUE(ctx.model.dirty);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "onea");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "one");
+    ASSERT_EQ(undo_perform(&ctx), 0);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 0);
+
+    ASSERT_EQ(undo_goto(&ctx, 3), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneab");
+    ASSERT_EQ(ctx.model.numrows, 3);
+
+    /* New groups carry on the numbering, and are kept in turn */
+    type_group(&ctx, 'c');
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 4);
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+
+    open_doc(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneabc");
+    ASSERT_EQ(undo_goto(&ctx, 1), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "onea");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+TEST(undo_history_follows_the_saved_branch) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');              /* 1 */
+    type_group(&ctx, 'b');              /* 2 */
+    ASSERT_EQ(editor_save(&ctx), 0);
+    undo_perform(&ctx);
+    type_group(&ctx, 'c');              /* 3, a branch from 1 */
+    ASSERT_EQ(editor_save(&ctx), 0);
+
+    /* Typed after the last save: on disk, but not what the file holds */
+    type_group(&ctx, 'd');
+    editor_ctx_free(&ctx);
+
+    open_doc(&ctx);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneac");
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 2);
+    ASSERT_EQ(redo_perform(&ctx), 0);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "onea");
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "one");
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_EQ(redo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneac");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+TEST(undo_history_journal_starts_with_the_first_edit) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    ASSERT_EQ(journal_size(), -1);
+    editor_ctx_free(&ctx);
+
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    ASSERT_TRUE(journal_size() > 0);
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+/* ============================================================================
+ * No History
+ * ============================================================================ */
+
+TEST(undo_history_is_dropped_when_the_file_changes) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+    long saved = journal_size();
+    ASSERT_TRUE(saved > 0);
+
+    FILE *f = fopen(TEST_FILE, "w");
+    fputs("changed elsewhere\n", f);
+    fclose(f);
+
+    open_doc(&ctx);
+    ASSERT_FALSE(undo_can_undo(&ctx));
+    ASSERT_EQ(undo_perform(&ctx), 0);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 0);
+    ASSERT_TRUE(journal_size() < saved);     /* Just the header */
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+TEST(undo_history_is_not_kept_when_turned_off) {
+    setup("one\n");
+    undo_journal_set_dir("");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+    ASSERT_EQ(journal_size(), -1);
+
+    open_doc(&ctx);
+    ASSERT_FALSE(undo_can_undo(&ctx));
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+TEST(undo_history_starts_with_the_first_save_of_a_new_file) {
+    setup("");
+    unlink(TEST_FILE);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ASSERT_EQ(editor_open(&ctx, TEST_FILE), -1);
+    editor_insert_row(&ctx, 0, "", 0);
+    type_group(&ctx, 'a');
+    type_group(&ctx, 'b');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+
+    open_doc(&ctx);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+/* ============================================================================
+ * Damaged Journals
+ * ============================================================================ */
+
+TEST(undo_history_drops_a_record_cut_short) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+    long saved = journal_size();
+
+    /* Half a record, as a crash in the middle of an append leaves */
+    char path[512];
+    journal_path(path, sizeof(path));
+    FILE *f = fopen(path, "ab");
+    fwrite("LKUR\001\0\0\0\377\377", 1, 10, f);
+    fclose(f);
+
+    open_doc(&ctx);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "one");
+    ASSERT_EQ(journal_size(), saved);
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+TEST(undo_history_stops_at_a_corrupted_group) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    type_group(&ctx, 'a');
+    type_group(&ctx, 'b');
+    type_group(&ctx, 'c');
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+
+    /* Flip the last byte of the first group's text ('a') */
+    char path[512];
+    journal_path(path, sizeof(path));
+    FILE *f = fopen(path, "r+b");
+    char *buf = malloc(4096);
+    size_t n = fread(buf, 1, 4096, f);
+    char *a = NULL;
+    for (size_t i = 0; !a && i + 5 <= n; i++)
+        if (memcmp(buf + i, "\001\0\0\0a", 5) == 0) a = buf + i + 4;
+    ASSERT_NOT_NULL(a);
+    *a = 'z';
+    fseek(f, 0, SEEK_SET);
+    fwrite(buf, 1, n, f);
+    fclose(f);
+    free(buf);
+
+    open_doc(&ctx);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_EQ(undo_perform(&ctx), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "onea");
+    ASSERT_EQ(undo_perform(&ctx), 0);
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+/* ============================================================================
+ * Limits
+ * ============================================================================ */
+
+TEST(undo_history_reads_back_what_the_limits_allow) {
+    setup("one\n");
+    editor_ctx_t ctx;
+    open_doc(&ctx);
+    for (char c = 'a'; c <= 'e'; c++) type_group(&ctx, c);
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+
+    editor_ctx_init(&ctx);
+    undo_free(&ctx);
+    undo_init(&ctx, 2, 10 * 1024 * 1024);
+    editor_open(&ctx, TEST_FILE);
+    ASSERT_EQ(undo_state_seq(&ctx, NULL), 5);
+
+    /* The newest two groups: states 3 to 5 */
+    ASSERT_EQ(undo_goto(&ctx, 2), -1);
+    ASSERT_EQ(undo_goto(&ctx, 3), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneabc");
+    ASSERT_EQ(undo_perform(&ctx), 0);
+    ASSERT_EQ(undo_goto(&ctx, 5), 1);
+    ASSERT_STR_EQ(ctx.model.row[0].chars, "oneabcde");
+    editor_ctx_free(&ctx);
+    teardown();
+}
+
+BEGIN_TEST_SUITE("Undo Journal")
+    /* Reopening */
+    RUN_TEST(undo_history_survives_reopening);
+    RUN_TEST(undo_history_follows_the_saved_branch);
+    RUN_TEST(undo_history_journal_starts_with_the_first_edit);
+
+    /* No history */
+    RUN_TEST(undo_history_is_dropped_when_the_file_changes);
+    RUN_TEST(undo_history_is_not_kept_when_turned_off);
+    RUN_TEST(undo_history_starts_with_the_first_save_of_a_new_file);
+
+    /* Damaged journals */
+    RUN_TEST(undo_history_drops_a_record_cut_short);
+    RUN_TEST(undo_history_stops_at_a_corrupted_group);
+
+    /* Limits */
+    RUN_TEST(undo_history_reads_back_what_the_limits_allow);
+END_TEST_SUITE()
@@ -0,0 +1,152 @@
+/* test_utf8.c - Unit tests for UTF-8 display widths
+ *
+ * Tests for:
+ * - Finding the end of an ASCII run, in and past whole blocks
+ * - Decoding, and refusing invalid sequences
+ * - East Asian and zero widths
+ * - Fitting text in cells without splitting characters
+ * - Row checkpoints agreeing with a plain count
+ * - Cursor cells, clicks, motion and wrapping of wide text in a buffer
+ */
+
+#include "test_framework.h"
+#include "utf8.h"
+#include "wrap.h"
+#include "internal.h"
+#include <string.h>
+
+#define NIHON "\xe6\x97\xa5\xe6\x9c\xac"    /* Two wide characters */
+#define E_ACUTE "\xc3\xa9"
+
+TEST(ascii_len_stops_at_first_other_byte) {
+    char buf[100];
+    memset(buf, 'a', sizeof(buf));
+    ASSERT_EQ(utf8_ascii_len(buf, 100), 100);
+    for (int at = 0; at < 40; at++) {
+        memset(buf, 'a', sizeof(buf));
+        buf[at] = (char)0xc3;
+        ASSERT_EQ(utf8_ascii_len(buf, 100), at);
+    }
+    ASSERT_EQ(utf8_ascii_len(buf, 0), 0);
+}
+
+TEST(decode_refuses_invalid_sequences) {
+    int cp;
+    ASSERT_EQ(utf8_decode("a", 1, &cp), 1);
+    ASSERT_EQ(cp, 'a');
+    ASSERT_EQ(utf8_decode(E_ACUTE, 2, &cp), 2);
+    ASSERT_EQ(cp, 0xe9);
+    ASSERT_EQ(utf8_decode(NIHON, 6, &cp), 3);
+    ASSERT_EQ(cp, 0x65e5);
+    ASSERT_EQ(utf8_decode("\xf0\x9f\x98\x80", 4, &cp), 4);
+    ASSERT_EQ(cp, 0x1f600);
+
+    ASSERT_EQ(utf8_decode("\xc3", 1, &cp), 1);          /* Cut short */
+    ASSERT_EQ(cp, -1);
+    ASSERT_EQ(utf8_decode("\xc0\xaf", 2, &cp), 1);      /* Overlong */
+    ASSERT_EQ(cp, -1);
+    ASSERT_EQ(utf8_decode("\xed\xa0\x80", 3, &cp), 1);  /* Surrogate */
+    ASSERT_EQ(cp, -1);
+    ASSERT_EQ(utf8_decode("\xa9", 1, &cp), 1);          /* Continuation */
+    ASSERT_EQ(cp, -1);
+}
+
+TEST(widths_of_text) {
+    ASSERT_EQ(utf8_cp_width('a'), 1);
+    ASSERT_EQ(utf8_cp_width(0xe9), 1);
+    ASSERT_EQ(utf8_cp_width(0x65e5), 2);
+    ASSERT_EQ(utf8_cp_width(0xac00), 2);        /* Hangul */
+    ASSERT_EQ(utf8_cp_width(0x1f600), 2);       /* Emoji */
+    ASSERT_EQ(utf8_cp_width(0x0301), 0);        /* Combining acute */
+    ASSERT_EQ(utf8_cp_width(0x200b), 0);        /* Zero width space */
+    ASSERT_EQ(utf8_cp_width(-1), 1);
+
+    ASSERT_EQ(utf8_width("caf" E_ACUTE, 5), 4);
+    ASSERT_EQ(utf8_width(NIHON "x", 7), 5);
+    ASSERT_EQ(utf8_width("e\xcc\x81", 3), 1);   /* e + combining acute */
+}
+
+TEST(fit_keeps_characters_whole) {
+    ASSERT_EQ(utf8_fit("hello", 5, 3), 3);
+    ASSERT_EQ(utf8_fit("hi", 2, 10), 2);
+    ASSERT_EQ(utf8_fit(NIHON, 6, 3), 3);        /* Half of the second: out */
+    ASSERT_EQ(utf8_fit(NIHON, 6, 4), 6);
+    ASSERT_EQ(utf8_fit("ab" E_ACUTE "cd", 6, 3), 4);
+    ASSERT_EQ(utf8_fit("e\xcc\x81x", 4, 1), 3); /* The mark goes along */
+}
+
+TEST(checkpoints_agree_with_counting) {
+    /* Past several chunks, mixing ASCII, wide and 2-byte characters */
+    char text[3000];
+    int len = 0;
+    while (len + 8 < (int)sizeof(text)) {
+        memcpy(text + len, "ab", 2);
+        memcpy(text + len + 2, NIHON, 6);
+        len += 8;
+        if (len % 40 == 0) {
+            memcpy(text + len, E_ACUTE, 2);
+            len += 2;
+        }
+    }
+    Utf8Cols *cache = utf8_cols_new();
+    ASSERT_NOT_NULL(cache);
+    for (int at = 0; at <= len; at += 37) {
+        while (at < len && utf8_is_cont(text[at])) at++;
+        ASSERT_EQ(utf8_cols_at(cache, 3, 7, text, len, at), utf8_width(text, at));
+    }
+    ASSERT_EQ(utf8_cols_at(cache, 3, 7, text, len, 5), utf8_width(text, 5));
+
+    /* A new change counts again; ASCII is counted a cell a byte */
+    ASSERT_EQ(utf8_cols_at(cache, 3, 8, "plain", 5, 4), 4);
+    ASSERT_EQ(utf8_cols_at(NULL, 3, 8, NIHON, 6, 6), 4);
+    utf8_cols_free(cache);
+}
+
+TEST(buffer_cursor_and_wrap_count_cells) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 5;
+    ctx.view.screencols = 20;
+    const char *text = NIHON " x";
+    editor_insert_row(&ctx, 0, (char *)text, strlen(text));
+
+    /* The cursor after the two wide characters is four cells in */
+    ctx.view.cx = 6;
+    ASSERT_EQ(editor_cursor_screen_col(&ctx), 4);
+    ctx.view.cx = 3;
+    ASSERT_EQ(editor_cursor_screen_col(&ctx), 2);
+
+    /* One step over a whole character */
+    editor_move_cursor(&ctx, ARROW_RIGHT);
+    ASSERT_EQ(ctx.view.cx, 6);
+    editor_move_cursor(&ctx, ARROW_LEFT);
+    ASSERT_EQ(ctx.view.cx, 3);
+
+    /* Either cell of a wide character is that character */
+    t_erow *row = &ctx.model.row[0];
+    ASSERT_EQ(editor_row_cell_to_cx(row, 0, 1), 0);
+    ASSERT_EQ(editor_row_cell_to_cx(row, 0, 3), 3);
+    ASSERT_EQ(editor_row_cell_to_cx(row, 0, 5), 7);
+    ASSERT_EQ(editor_row_cells(&ctx.model, row, 0, row->rsize), 6);
+
+    /* Wrapped at 5 cells: two wide characters a screen row */
+    WrapCache *cache = wrap_cache_new();
+    const char *wide = NIHON NIHON "\xe6\x97\xa5";
+    const int *starts, *widths;
+    ASSERT_EQ(wrap_row(cache, 0, wide, (int)strlen(wide), 5, &starts, &widths), 3);
+    ASSERT_EQ(starts[1], 6);
+    ASSERT_EQ(starts[2], 12);
+    ASSERT_EQ(widths[0], 4);
+    ASSERT_EQ(widths[2], 5);
+    wrap_cache_free(cache);
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("UTF-8")
+    RUN_TEST(ascii_len_stops_at_first_other_byte);
+    RUN_TEST(decode_refuses_invalid_sequences);
+    RUN_TEST(widths_of_text);
+    RUN_TEST(fit_keeps_characters_whole);
+    RUN_TEST(checkpoints_agree_with_counting);
+    RUN_TEST(buffer_cursor_and_wrap_count_cells);
+END_TEST_SUITE()
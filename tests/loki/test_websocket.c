@@ -0,0 +1,467 @@
+/* test_websocket.c - Unit tests for the WebSocket transport of the RPC server
+ *
+ * Tests for:
+ * - The handshake: request heads, the accept key and permessage-deflate
+ * - Masked frames fed in pieces, fragmented messages, ping and close
+ * - Protocol errors answered with a close frame
+ * - Messages compressed, each with the dictionary of those before
+ * - A browser's connection to the RPC server, and files of the web root
+ */
+
+#include "test_framework.h"
+#include "websocket.h"
+#include "rpc_server.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef LOKI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define TEST_ROOT "/tmp/loki_websocket_test"
+
+#define UPGRADE_HEAD "GET /rpc HTTP/1.1\r\n" \
+    "Host: localhost\r\n" \
+    "Upgrade: websocket\r\n" \
+    "Connection: Upgrade\r\n" \
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n" \
+    "Sec-WebSocket-Version: 13\r\n"
+
+/* What a WsSocket handed on: messages, and the bytes it wrote */
+static char messages[4096];
+static size_t messages_len;
+static int last_opcode;
+static unsigned char wire[1 << 16];
+static size_t wire_len;
+
+static void on_message(void *opaque, int opcode, const char *data, size_t len) {
+    (void)opaque;
+    memcpy(messages + messages_len, data, len);
+    messages_len += len;
+    messages[messages_len++] = '|';
+    messages[messages_len] = '\0';
+    last_opcode = opcode;
+}
+
+static void on_write(void *opaque, const char *data, size_t len) {
+    (void)opaque;
+    memcpy(wire + wire_len, data, len);
+    wire_len += len;
+}
+
+static WsSocket *open_socket(const char *extensions) {
+    char head[1024];
+    snprintf(head, sizeof(head), UPGRADE_HEAD "%s\r\n", extensions);
+    WsRequest req;
+    if (ws_parse_request(head, strlen(head), &req) <= 0) return NULL;
+    messages_len = wire_len = 0;
+    messages[0] = '\0';
+    WsCallbacks cb = { on_message, on_write, NULL };
+    return ws_new(&req, &cb);
+}
+
+/* Helper: A client's frame of 'len' bytes, masked, into 'out'. Returns
+ * its length. */
+static size_t client_frame(unsigned char *out, int fin, int rsv1, int opcode,
+                           const void *data, size_t len) {
+    static const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    size_t n = 0;
+    out[n++] = (unsigned char)((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+    if (len < 126) {
+        out[n++] = (unsigned char)(0x80 | len);
+    } else {
+        out[n++] = 0x80 | 126;
+        out[n++] = (unsigned char)(len >> 8);
+        out[n++] = (unsigned char)len;
+    }
+    memcpy(out + n, mask, 4);
+    n += 4;
+    for (size_t i = 0; i < len; i++) out[n + i] = ((const unsigned char *)data)[i] ^ mask[i & 3];
+    return n + len;
+}
+
+/* Helper: The server's frame at 'p': its payload and length through
+ * 'data' and 'len'. Returns the frame's length, or 0 if not all there. */
+static size_t server_frame(const unsigned char *p, size_t have, int *opcode, int *rsv1,
+                           const unsigned char **data, size_t *len) {
+    if (have < 2) return 0;
+    size_t n = p[1] & 0x7f, head = 2;
+    if (n == 126) {
+        if (have < 4) return 0;
+        n = (size_t)p[2] << 8 | p[3];
+        head = 4;
+    } else if (n == 127) {
+        if (have < 10) return 0;
+        n = 0;
+        for (int i = 0; i < 8; i++) n = n << 8 | p[2 + i];
+        head = 10;
+    }
+    if (have < head + n) return 0;
+    *opcode = p[0] & 0x0f;
+    *rsv1 = (p[0] & 0x40) != 0;
+    *data = p + head;
+    *len = n;
+    return head + n;
+}
+
+TEST(ws_handshake) {
+    char key[29];
+    ws_accept_key("dGhlIHNhbXBsZSBub25jZQ==", key);
+    ASSERT_STR_EQ(key, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+    WsRequest req;
+    const char *head = UPGRADE_HEAD "\r\n";
+    ASSERT_EQ(ws_parse_request(head, 20, &req), 0);
+    ASSERT_EQ(ws_parse_request(head, strlen(head), &req), (int)strlen(head));
+    ASSERT_TRUE(req.upgrade);
+    ASSERT_STR_EQ(req.path, "/rpc");
+    ASSERT_FALSE(req.deflate);
+
+    char out[WS_RESPONSE_MAX];
+    size_t len = ws_handshake_response(&req, out);
+    ASSERT_EQ(len, strlen(out));
+    ASSERT_TRUE(strncmp(out, "HTTP/1.1 101 ", 13) == 0);
+    ASSERT_TRUE(strstr(out, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != NULL);
+    ASSERT_TRUE(strstr(out, "Extensions") == NULL);
+    ASSERT_TRUE(strcmp(out + len - 4, "\r\n\r\n") == 0);
+
+    /* A plain GET, and what is not one */
+    const char *plain = "GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n";
+    ASSERT_TRUE(ws_parse_request(plain, strlen(plain), &req) > 0);
+    ASSERT_FALSE(req.upgrade);
+    ASSERT_STR_EQ(req.path, "/index.html");
+    ASSERT_EQ(ws_parse_request("POST / HTTP/1.1\r\n\r\n", 19, &req), -1);
+
+#ifdef LOKI_HAVE_ZLIB
+    /* The first offer taken, if any */
+    char ext[1024];
+    snprintf(ext, sizeof(ext), UPGRADE_HEAD "Sec-WebSocket-Extensions: "
+             "permessage-deflate; server_max_window_bits=10, "
+             "permessage-deflate; server_no_context_takeover; client_max_window_bits\r\n\r\n");
+    ASSERT_TRUE(ws_parse_request(ext, strlen(ext), &req) > 0);
+    ASSERT_TRUE(req.deflate);
+    ASSERT_TRUE(req.no_context);
+    ws_handshake_response(&req, out);
+    ASSERT_TRUE(strstr(out, "permessage-deflate; server_no_context_takeover\r\n") != NULL);
+#endif
+}
+
+TEST(ws_frames_in_pieces) {
+    WsSocket *ws = open_socket("");
+    unsigned char in[512];
+    size_t n = 0;
+    n += client_frame(in + n, 0, 0, WS_TEXT, "{\"cmd\":", 7);
+    n += client_frame(in + n, 1, 0, WS_PING, "hi", 2);
+    n += client_frame(in + n, 1, 0, WS_CONTINUATION, "\"status\"}", 9);
+    n += client_frame(in + n, 1, 0, WS_BINARY, "\x81\xa3" "cmd", 5);
+
+    /* A byte at a time: only whole frames count */
+    for (size_t i = 0; i < n; i++) ASSERT_EQ(ws_feed(ws, (const char *)in + i, 1), 0);
+    ASSERT_STR_EQ(messages, "{\"cmd\":\"status\"}|\x81\xa3" "cmd|");
+    ASSERT_EQ(last_opcode, WS_BINARY);
+    ASSERT_EQ(ws_last_opcode(ws), WS_BINARY);
+
+    /* The ping answered in between */
+    int opcode, rsv1;
+    const unsigned char *data;
+    size_t len;
+    ASSERT_EQ(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len), 4);
+    ASSERT_EQ(opcode, WS_PONG);
+    ASSERT_TRUE(memcmp(data, "hi", 2) == 0);
+
+    /* Sent unmasked, in one frame */
+    wire_len = 0;
+    ws_send(ws, WS_TEXT, "{\"ok\":true}\n", 12);
+    ASSERT_EQ(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len), wire_len);
+    ASSERT_EQ(wire[1], 12);
+    ASSERT_EQ(opcode, WS_TEXT);
+    ASSERT_TRUE(memcmp(data, "{\"ok\":true}\n", 12) == 0);
+
+    /* Close echoed, and nothing after it */
+    wire_len = 0;
+    n = client_frame(in, 1, 0, WS_CLOSE, "\x03\xe9", 2);
+    ASSERT_EQ(ws_feed(ws, (const char *)in, n), 1);
+    ASSERT_EQ(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len), 4);
+    ASSERT_EQ(opcode, WS_CLOSE);
+    ASSERT_EQ(data[0] << 8 | data[1], 1001);
+    ws_send(ws, WS_TEXT, "late", 4);
+    ASSERT_EQ(wire_len, 4);
+
+    WsStats st;
+    ws_stats(ws, &st);
+    ASSERT_EQ(st.messages_in, 2);
+    ASSERT_EQ(st.messages_out, 1);
+    ASSERT_EQ(st.bytes_in, 21);
+    ws_free(ws);
+}
+
+TEST(ws_protocol_errors_close) {
+    int opcode, rsv1;
+    const unsigned char *data;
+    size_t len;
+
+    /* Unmasked */
+    WsSocket *ws = open_socket("");
+    ASSERT_EQ(ws_feed(ws, "\x81\x02hi", 4), 1);
+    ASSERT_TRUE(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len) > 0);
+    ASSERT_EQ(opcode, WS_CLOSE);
+    ASSERT_EQ(data[0] << 8 | data[1], 1002);
+    ws_free(ws);
+
+    /* A continuation of nothing */
+    unsigned char in[64];
+    ws = open_socket("");
+    ASSERT_EQ(ws_feed(ws, (const char *)in, client_frame(in, 1, 0, WS_CONTINUATION, "x", 1)), 1);
+    ASSERT_TRUE(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len) > 0);
+    ASSERT_EQ(data[0] << 8 | data[1], 1002);
+    ws_free(ws);
+
+    /* Larger than taken: refused from its header */
+    ws = open_socket("");
+    const unsigned char big[] = {0x82, 0xff, 0, 0, 0, 0, 0x10, 0, 0, 0};
+    ASSERT_EQ(ws_feed(ws, (const char *)big, sizeof(big)), 1);
+    ASSERT_TRUE(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len) > 0);
+    ASSERT_EQ(data[0] << 8 | data[1], 1009);
+    ws_free(ws);
+}
+
+#ifdef LOKI_HAVE_ZLIB
+/* Helper: Inflate a compressed message with the client's stream */
+static size_t client_inflate(z_stream *z, const unsigned char *data, size_t len,
+                             char *out, size_t cap) {
+    unsigned char in[8192];
+    memcpy(in, data, len);
+    memcpy(in + len, "\x00\x00\xff\xff", 4);
+    z->next_in = in;
+    z->avail_in = (uInt)(len + 4);
+    z->next_out = (Bytef *)out;
+    z->avail_out = (uInt)cap;
+    inflate(z, Z_SYNC_FLUSH);
+    return cap - z->avail_out;
+}
+
+TEST(ws_messages_compressed) {
+    WsSocket *ws = open_socket("Sec-WebSocket-Extensions: permessage-deflate\r\n");
+    z_stream z = {0};
+    ASSERT_EQ(inflateInit2(&z, -15), Z_OK);
+
+    char frame[2048];
+    size_t flen = 0;
+    for (int i = 0; i < 24; i++)
+        flen += (size_t)snprintf(frame + flen, sizeof(frame) - flen,
+                                 "{\"row\":%d,\"text\":\"int main(void) { return 0; }\"}\n", i);
+
+    /* The same frame twice: the second a fraction of the first */
+    size_t sizes[2];
+    for (int k = 0; k < 2; k++) {
+        wire_len = 0;
+        ws_send(ws, WS_TEXT, frame, flen);
+        int opcode, rsv1;
+        const unsigned char *data;
+        size_t len;
+        ASSERT_EQ(server_frame(wire, wire_len, &opcode, &rsv1, &data, &len), wire_len);
+        ASSERT_TRUE(rsv1);
+        char out[4096];
+        ASSERT_EQ(client_inflate(&z, data, len, out, sizeof(out)), flen);
+        ASSERT_TRUE(memcmp(out, frame, flen) == 0);
+        sizes[k] = len;
+    }
+    ASSERT_TRUE(sizes[0] < flen / 2);
+    ASSERT_TRUE(sizes[1] < sizes[0] / 4);
+
+    /* Short messages as they are */
+    wire_len = 0;
+    ws_send(ws, WS_TEXT, "{}", 2);
+    ASSERT_EQ(wire[0], 0x81);
+
+    /* A compressed message from the client */
+    z_stream d = {0};
+    ASSERT_EQ(deflateInit2(&d, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY), Z_OK);
+    unsigned char packed[4096];
+    d.next_in = (Bytef *)frame;
+    d.avail_in = (uInt)flen;
+    d.next_out = packed;
+    d.avail_out = sizeof(packed);
+    deflate(&d, Z_SYNC_FLUSH);
+    size_t plen = sizeof(packed) - d.avail_out - 4;
+    deflateEnd(&d);
+    unsigned char in[8192];
+    messages_len = 0;
+    ASSERT_EQ(ws_feed(ws, (const char *)in, client_frame(in, 1, 1, WS_TEXT, packed, plen)), 0);
+    ASSERT_EQ(messages_len, flen + 1);
+    ASSERT_TRUE(memcmp(messages, frame, flen) == 0);
+
+    WsStats st;
+    ws_stats(ws, &st);
+    ASSERT_TRUE(st.wire_out < st.bytes_out / 2);
+    inflateEnd(&z);
+    ws_free(ws);
+}
+#endif
+
+/* ============================ The RPC server ============================== */
+
+static uv_loop_t loop;
+
+static int connect_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Helper: Run the server until 'fd' has sent 'want' bytes, or closed.
+ * Returns the bytes read into 'buf'. */
+static size_t recv_some(int fd, unsigned char *buf, size_t cap, size_t want) {
+    size_t len = 0;
+    for (int tries = 0; tries < 500 && len < want; tries++) {
+        uv_run(&loop, UV_RUN_NOWAIT);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 2) <= 0) continue;
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    return len;
+}
+
+/* Helper: Run the server until a frame comes to 'fd', and return its
+ * payload (in a static buffer, as a string). Bytes after it are kept for
+ * the next call. */
+static const char *recv_message(int fd, int *opcode) {
+    static unsigned char buf[65536];
+    static size_t have;
+    static char text[65536];
+    size_t used;
+    int rsv1;
+    const unsigned char *data;
+    size_t len;
+    while ((used = server_frame(buf, have, opcode, &rsv1, &data, &len)) == 0) {
+        size_t got = recv_some(fd, buf + have, sizeof(buf) - have, 1);
+        if (got == 0) return NULL;
+        have += got;
+    }
+    memcpy(text, data, len);
+    text[len] = '\0';
+    memmove(buf, buf + used, have - used);
+    have -= used;
+    return text;
+}
+
+TEST(ws_rpc_server_speaks_to_browsers) {
+    char err[256];
+    uv_loop_init(&loop);
+    EditorConfig config = {0};
+    RpcServer *server = rpc_server_start(&loop, "tcp:127.0.0.1:0", &config, err, sizeof(err));
+    ASSERT_NOT_NULL(server);
+    int fd = connect_tcp(rpc_server_port(server));
+    ASSERT_TRUE(fd >= 0);
+
+    /* The handshake, and a command in the same packet */
+    unsigned char out[1024];
+    size_t n = strlen(UPGRADE_HEAD "\r\n");
+    memcpy(out, UPGRADE_HEAD "\r\n", n);
+    n += client_frame(out + n, 1, 0, WS_TEXT, "{\"cmd\":\"status\"}", 16);
+    ASSERT_EQ(write(fd, out, n), (ssize_t)n);
+
+    unsigned char buf[1024];
+    const char *response = "HTTP/1.1 101 Switching Protocols\r\n";
+    ASSERT_TRUE(recv_some(fd, buf, strlen(response), strlen(response)) == strlen(response));
+    ASSERT_TRUE(memcmp(buf, response, strlen(response)) == 0);
+    size_t len = 0;
+    while (len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4) != 0) {
+        ASSERT_EQ(recv_some(fd, buf + len, 1, 1), 1);
+        len++;
+    }
+
+    int opcode;
+    const char *msg = recv_message(fd, &opcode);
+    ASSERT_NOT_NULL(msg);
+    ASSERT_EQ(opcode, WS_TEXT);
+    ASSERT_STR_EQ(msg, "{\"ok\":true,\"mode\":\"normal\",\"filename\":null,\"dirty\":false}\n");
+    ASSERT_EQ(rpc_server_clients(server), 1);
+
+    /* quit: its response, then the close */
+    n = client_frame(out, 1, 0, WS_TEXT, "{\"cmd\":\"quit\"}\n", 15);
+    ASSERT_EQ(write(fd, out, n), (ssize_t)n);
+    msg = recv_message(fd, &opcode);
+    ASSERT_NOT_NULL(msg);
+    ASSERT_TRUE(strncmp(msg, "{\"ok\":true", 10) == 0);
+    msg = recv_message(fd, &opcode);
+    ASSERT_EQ(opcode, WS_CLOSE);
+    close(fd);
+    for (int i = 0; i < 10; i++) uv_run(&loop, UV_RUN_NOWAIT);
+    ASSERT_EQ(rpc_server_clients(server), 0);
+
+    rpc_server_close(server);
+    uv_loop_close(&loop);
+}
+
+TEST(ws_rpc_server_serves_the_web_root) {
+    mkdir(TEST_ROOT, 0755);
+    FILE *f = fopen(TEST_ROOT "/index.html", "w");
+    fputs("<script src=loki.js></script>\n", f);
+    fclose(f);
+
+    char err[256];
+    uv_loop_init(&loop);
+    EditorConfig config = {0};
+    RpcServer *server = rpc_server_start(&loop, "tcp:127.0.0.1:0", &config, err, sizeof(err));
+    ASSERT_NOT_NULL(server);
+    int port = rpc_server_port(server);
+
+    static const struct { const char *path, *status; int web_root; } cases[] = {
+        {"/", "HTTP/1.1 404", 0},
+        {"/", "HTTP/1.1 200", 1},
+        {"/index.html?v=2", "HTTP/1.1 200", 1},
+        {"/../etc/passwd", "HTTP/1.1 404", 1},
+        {"/none.js", "HTTP/1.1 404", 1},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        rpc_server_set_web_root(server, cases[i].web_root ? TEST_ROOT : NULL);
+        int fd = connect_tcp(port);
+        char req[256];
+        snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: x\r\n\r\n", cases[i].path);
+        ASSERT_EQ(write(fd, req, strlen(req)), (ssize_t)strlen(req));
+        char buf[1024];
+        size_t len = recv_some(fd, (unsigned char *)buf, sizeof(buf) - 1, sizeof(buf));
+        buf[len] = '\0';
+        ASSERT_TRUE(strncmp(buf, cases[i].status, strlen(cases[i].status)) == 0);
+        if (strstr(cases[i].status, "200")) {
+            ASSERT_TRUE(strstr(buf, "Content-Type: text/html") != NULL);
+            ASSERT_TRUE(strstr(buf, "\r\n\r\n<script src=loki.js></script>\n") != NULL);
+        }
+        close(fd);
+    }
+    for (int i = 0; i < 10; i++) uv_run(&loop, UV_RUN_NOWAIT);
+    ASSERT_EQ(rpc_server_clients(server), 0);
+
+    rpc_server_close(server);
+    uv_loop_close(&loop);
+    remove(TEST_ROOT "/index.html");
+    rmdir(TEST_ROOT);
+}
+
+BEGIN_TEST_SUITE("WebSocket")
+    RUN_TEST(ws_handshake);
+    RUN_TEST(ws_frames_in_pieces);
+    RUN_TEST(ws_protocol_errors_close);
+#ifdef LOKI_HAVE_ZLIB
+    RUN_TEST(ws_messages_compressed);
+#endif
+    RUN_TEST(ws_rpc_server_speaks_to_browsers);
+    RUN_TEST(ws_rpc_server_serves_the_web_root);
+END_TEST_SUITE()
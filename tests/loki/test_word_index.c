@@ -0,0 +1,225 @@
+/* test_word_index.c - Unit tests for the buffer word index
+ *
+ * Tests for:
+ * - Words counted once the buffer is indexed, and kept counted as rows
+ *   are inserted, changed and deleted
+ * - Matches ranked by nearness to the cursor, then by how often they
+ *   occur; the prefix itself left out
+ * - Words of the other open buffers
+ * - Ctrl-N in INSERT mode cycling through the matches and back
+ * - Large buffers indexed on the pool, with edits made meanwhile
+ */
+
+#include "test_framework.h"
+#include "word_index.h"
+#include "buffers.h"
+#include "task_pool.h"
+#include "async_queue.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void fill(editor_ctx_t *ctx, int n, const char **lines) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    for (int i = 0; i < n; i++) {
+        char line[256];         /* editor_insert_row() takes it mutable */
+        size_t len = strlen(lines[i]);
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+        memcpy(line, lines[i], len);
+        line[len] = '\0';
+        editor_insert_row(ctx, i, line, len);
+    }
+}
+
+static int count(editor_ctx_t *ctx, const char *word) {
+    return word_index_count(&ctx->model, word, strlen(word));
+}
+
+static void free_all(char **out, int n) {
+    for (int i = 0; i < n; i++) free(out[i]);
+}
+
+TEST(word_index_counts_follow_edits) {
+    const char *lines[] = { "alpha beta alpha", "gamma 9lives be", "alpha_two" };
+    editor_ctx_t ctx;
+    fill(&ctx, 3, lines);
+    word_index_enable(&ctx);
+    ASSERT_TRUE(word_index_ready(&ctx.model));
+    ASSERT_EQ(count(&ctx, "alpha"), 2);
+    ASSERT_EQ(count(&ctx, "beta"), 1);
+    ASSERT_EQ(count(&ctx, "alpha_two"), 1);
+    ASSERT_EQ(count(&ctx, "be"), 0);          /* Too short */
+    ASSERT_EQ(count(&ctx, "lives"), 0);       /* Part of "9lives" */
+
+    editor_insert_row(&ctx, 1, "alpha delta", 11);
+    ASSERT_EQ(count(&ctx, "alpha"), 3);
+    ASSERT_EQ(count(&ctx, "delta"), 1);
+
+    editor_row_set(&ctx, &ctx.model.row[0], "omega", 5);
+    ASSERT_EQ(count(&ctx, "alpha"), 1);
+    ASSERT_EQ(count(&ctx, "beta"), 0);
+    ASSERT_EQ(count(&ctx, "omega"), 1);
+
+    editor_del_row(&ctx, 1);
+    ASSERT_EQ(count(&ctx, "alpha"), 0);
+    ASSERT_EQ(count(&ctx, "delta"), 0);
+    ASSERT_EQ(count(&ctx, "gamma"), 1);
+    ASSERT_TRUE(word_index_ready(&ctx.model));
+
+    word_index_free(&ctx.model);
+    ASSERT_EQ(count(&ctx, "gamma"), 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(word_index_ranks_near_then_frequent) {
+    const char *lines[300];
+    for (int i = 0; i < 300; i++) lines[i] = "";
+    lines[0] = "printf printf printf";
+    lines[1] = "print print";
+    lines[150] = "printer";
+    lines[152] = "prin";
+    editor_ctx_t ctx;
+    fill(&ctx, 300, lines);
+
+    /* Near row 152, only "printer" is within reach */
+    editor_cursor_to(&ctx, 152, 4);
+    char *out[8];
+    int n = word_index_query(&ctx, "prin", 4, out, 8);
+    ASSERT_EQ(n, 3);
+    ASSERT_STR_EQ(out[0], "printer");
+    ASSERT_STR_EQ(out[1], "printf");
+    ASSERT_STR_EQ(out[2], "print");
+    free_all(out, n);
+
+    /* At the top, the nearest: row 0, then row 1 */
+    editor_cursor_to(&ctx, 2, 0);
+    n = word_index_query(&ctx, "prin", 4, out, 8);
+    ASSERT_EQ(n, 3);
+    ASSERT_STR_EQ(out[0], "print");
+    ASSERT_STR_EQ(out[1], "printf");
+    ASSERT_STR_EQ(out[2], "printer");
+    free_all(out, n);
+
+    /* The prefix itself is no match */
+    n = word_index_query(&ctx, "print", 5, out, 8);
+    ASSERT_EQ(n, 2);
+    free_all(out, n);
+    n = word_index_query(&ctx, "zzz", 3, out, 8);
+    ASSERT_EQ(n, 0);
+    editor_ctx_free(&ctx);
+}
+
+TEST(word_index_other_buffers) {
+    editor_ctx_t init;
+    fill(&init, 1, (const char *[]){ "handle_one" });
+    ASSERT_EQ(buffers_init(&init), 0);
+    editor_ctx_t *first = buffer_get_current();
+
+    int id = buffer_create(NULL);
+    ASSERT_TRUE(id > 0);
+    const EditorView *view;
+    editor_ctx_t *other = buffer_peek(id, &view);
+    ASSERT_NOT_NULL(other);
+    editor_insert_row(other, 0, "handle_two handle_two", 21);
+    word_index_enable(other);
+
+    editor_cursor_to(first, 0, 0);
+    char *out[8];
+    int n = word_index_query(first, "hand", 4, out, 8);
+    ASSERT_EQ(n, 2);
+    ASSERT_STR_EQ(out[0], "handle_one");    /* Near the cursor */
+    ASSERT_STR_EQ(out[1], "handle_two");
+    free_all(out, n);
+
+    buffers_free();
+    editor_ctx_free(&init);
+}
+
+TEST(word_index_ctrl_n_cycles) {
+    const char *lines[] = { "counter country", "" };
+    editor_ctx_t ctx;
+    fill(&ctx, 2, lines);
+    editor_row_set(&ctx, &ctx.model.row[1], "cou", 3);
+    editor_cursor_to(&ctx, 1, 3);
+    ctx.view.mode = MODE_INSERT;
+
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "counter");
+    ASSERT_EQ(ctx.view.cx, 7);
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "country");
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "cou");
+    ASSERT_EQ(ctx.view.cx, 3);
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "counter");
+
+    /* Another key ends it: Ctrl-N completes the new word */
+    modal_process_insert_mode_key(&ctx, 0, ' ');
+    modal_process_insert_mode_key(&ctx, 0, 'c');
+    modal_process_insert_mode_key(&ctx, 0, 'o');
+    modal_process_insert_mode_key(&ctx, 0, 'u');
+    modal_process_insert_mode_key(&ctx, 0, 'n');
+    modal_process_insert_mode_key(&ctx, 0, 't');
+    modal_process_insert_mode_key(&ctx, 0, 'r');
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "counter country");
+
+    /* No word before the cursor: nothing changes */
+    modal_process_insert_mode_key(&ctx, 0, ' ');
+    modal_process_insert_mode_key(&ctx, 0, CTRL_N);
+    ASSERT_STR_EQ(ctx.model.row[1].chars, "counter country ");
+    editor_ctx_free(&ctx);
+}
+
+TEST(word_index_large_buffer_on_pool) {
+    async_queue_cleanup();
+    ASSERT_EQ(async_queue_init(), 0);
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+    char line[32];
+    int rows = WORD_INDEX_ASYNC_ROWS + 500;
+    for (int i = 0; i < rows; i++) {
+        int len = snprintf(line, sizeof(line), "word%d common", i);
+        editor_insert_row(&ctx, i, line, (size_t)len);
+    }
+    word_index_enable(&ctx);
+
+    /* Edited while the build runs: the edit is applied once it is in */
+    editor_insert_row(&ctx, 0, "latecomer common", 16);
+    for (int i = 0; i < 5000 && !word_index_ready(&ctx.model); i++) {
+        async_queue_dispatch_all(NULL, &ctx);
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    ASSERT_TRUE(word_index_ready(&ctx.model));
+    ASSERT_EQ(count(&ctx, "common"), rows + 1);
+    ASSERT_EQ(count(&ctx, "latecomer"), 1);
+    ASSERT_EQ(count(&ctx, "word7"), 1);
+
+    /* Given up while it runs: its event finds no index */
+    word_index_enable(&ctx);
+    word_index_free(&ctx.model);
+    for (int i = 0; i < 50; i++) {
+        async_queue_dispatch_all(NULL, &ctx);
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    editor_ctx_free(&ctx);
+    task_pool_shutdown();
+    async_queue_cleanup();
+}
+
+BEGIN_TEST_SUITE("Word Index")
+    RUN_TEST(word_index_counts_follow_edits);
+    RUN_TEST(word_index_ranks_near_then_frequent);
+    RUN_TEST(word_index_other_buffers);
+    RUN_TEST(word_index_ctrl_n_cycles);
+    RUN_TEST(word_index_large_buffer_on_pool);
+END_TEST_SUITE()
@@ -0,0 +1,169 @@
+/* test_wrap.c - Unit tests for soft wrap
+ *
+ * Tests for:
+ * - Breaking rows after a blank, or right at the width
+ * - TABs taking their render columns
+ * - Breaks cached per row, and moved or dropped by edits
+ * - A new width starting the cache over
+ * - Screen lines, scrolling and the cursor over wrapped rows
+ */
+
+#include "test_framework.h"
+#include "wrap.h"
+#include "internal.h"
+#include <string.h>
+
+static int wrap(WrapCache *cache, int row, const char *s, int width,
+                const int **starts) {
+    const int *widths;
+    return wrap_row(cache, row, s, (int)strlen(s), width, starts, &widths);
+}
+
+TEST(wrap_breaks_after_blank_or_at_width) {
+    WrapCache *cache = wrap_cache_new();
+    ASSERT_NOT_NULL(cache);
+    const int *starts;
+
+    ASSERT_EQ(wrap(cache, 0, "short", 10, &starts), 1);
+    ASSERT_EQ(starts[0], 0);
+
+    /* "aaaa bbbb " then "cccc" */
+    ASSERT_EQ(wrap(cache, 1, "aaaa bbbb cccc", 10, &starts), 2);
+    ASSERT_EQ(starts[0], 0);
+    ASSERT_EQ(starts[1], 10);
+
+    /* No blank: hard breaks */
+    ASSERT_EQ(wrap(cache, 2, "abcdefghijklmnopqrstuvwxy", 10, &starts), 3);
+    ASSERT_EQ(starts[1], 10);
+    ASSERT_EQ(starts[2], 20);
+
+    /* A blank early in the row would leave it less than half full */
+    ASSERT_EQ(wrap(cache, 3, "ab cdefghijklmno", 10, &starts), 2);
+    ASSERT_EQ(starts[1], 10);
+
+    /* "one two three four": the second row starts after "two " */
+    ASSERT_EQ(wrap(cache, 4, "one two three four", 10, &starts), 2);
+    ASSERT_EQ(starts[1], 8);
+    wrap_cache_free(cache);
+}
+
+TEST(wrap_counts_tab_columns) {
+    WrapCache *cache = wrap_cache_new();
+    const int *starts;
+
+    /* Three TABs take 23 columns, then "abc" */
+    ASSERT_EQ(wrap(cache, 0, "\t\t\tabc", 10, &starts), 3);
+    ASSERT_EQ(starts[1], 10);
+    ASSERT_EQ(starts[2], 20);
+
+    /* Fewer chars than the width, but wider */
+    ASSERT_EQ(wrap(cache, 1, "\t\tx", 10, &starts), 2);
+    wrap_cache_free(cache);
+}
+
+TEST(wrap_caches_and_follows_edits) {
+    WrapCache *cache = wrap_cache_new();
+    const char *text = "aaaa bbbb cccc dddd";
+    const int *starts;
+
+    ASSERT_EQ(wrap(cache, 5, text, 10, &starts), 2);
+    ASSERT_EQ(wrap(cache, 5, text, 10, &starts), 2);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+    wrap(cache, 0, "short", 10, &starts);   /* Fits: not kept */
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+
+    /* A row inserted above moves it down */
+    wrap_note_insert(cache, 3);
+    wrap(cache, 6, text, 10, &starts);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+
+    /* A change drops it */
+    wrap_note_change(cache, 6);
+    ASSERT_EQ(wrap_cached_rows(cache), 0);
+
+    /* Deleting a row drops its breaks and moves those below up */
+    wrap(cache, 2, text, 10, &starts);
+    wrap(cache, 8, text, 10, &starts);
+    wrap_note_delete(cache, 2);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+    wrap(cache, 7, text, 10, &starts);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+
+    /* Deleting several rows drops theirs and moves those below up */
+    wrap(cache, 20, text, 10, &starts);
+    wrap(cache, 30, text, 10, &starts);
+    wrap_note_delete_rows(cache, 5, 20);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+    wrap(cache, 10, text, 10, &starts);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+    wrap_note_delete_rows(cache, 0, 30);
+    ASSERT_EQ(wrap_cached_rows(cache), 0);
+    wrap(cache, 7, text, 10, &starts);
+
+    /* A new width lays everything out again */
+    ASSERT_EQ(wrap(cache, 7, text, 15, &starts), 2);
+    ASSERT_EQ(starts[1], 15);
+    ASSERT_EQ(wrap_cached_rows(cache), 1);
+    wrap_cache_free(cache);
+}
+
+TEST(screen_and_cursor_follow_wrapped_rows) {
+    editor_ctx_t ctx;
+    editor_ctx_init(&ctx);
+    ctx.view.word_wrap = 1;
+    ctx.view.screenrows = 4;
+    ctx.view.screencols = 10;
+    const char *lines[] = { "short", "aaaa bbbb cccc dddd", "x", "y", "z" };
+    for (int i = 0; i < 5; i++)
+        editor_insert_row(&ctx, i, (char *)lines[i], strlen(lines[i]));
+
+    int n, wrapped;
+    const ScreenLine *sl = editor_screen_lines(&ctx, 4, &n, &wrapped);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(wrapped, 1);
+    ASSERT_EQ(sl[1].row, 1);
+    ASSERT_EQ(sl[1].len, 10);
+    ASSERT_EQ(sl[2].row, 1);
+    ASSERT_EQ(sl[2].start, 10);
+    ASSERT_EQ(sl[3].row, 2);
+
+    /* On the 'c' of "cccc": second screen row of row 1 */
+    ctx.view.cy = 1;
+    ctx.view.cx = 12;
+    ASSERT_EQ(editor_cursor_screen_row(&ctx), 2);
+    ASSERT_EQ(editor_cursor_screen_col(&ctx), 2);
+    int start;
+    ASSERT_EQ(editor_screen_row_to_row(&ctx, 2, &start), 1);
+    ASSERT_EQ(start, 10);
+    ASSERT_EQ(editor_screen_row_to_row(&ctx, 3, &start), 2);
+    ASSERT_EQ(start, 0);
+
+    /* A horizontal scroll is folded into the cursor on a wrapped row */
+    ctx.view.coloff = 3;
+    ctx.view.cx = 1;
+    editor_view_fix(&ctx);
+    ASSERT_EQ(ctx.view.coloff, 0);
+    ASSERT_EQ(ctx.view.cx, 4);
+
+    /* Rows 0-4 take six screen rows: showing row 4 scrolls by two */
+    ctx.view.cx = 0;
+    editor_scroll_to_row(&ctx, 4);
+    ASSERT_EQ(ctx.view.rowoff, 2);
+    ASSERT_EQ(editor_cursor_screen_row(&ctx), 2);
+
+    /* Editing the wrapped row lays it out again */
+    editor_scroll_to_row(&ctx, 1);
+    ctx.view.cx = 0;
+    editor_insert_char(&ctx, 'a');
+    editor_scroll_to_row(&ctx, 0);
+    sl = editor_screen_lines(&ctx, 4, &n, &wrapped);
+    ASSERT_EQ(sl[2].start, 10);     /* "aaaaa bbbb" fits */
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("Wrap")
+    RUN_TEST(wrap_breaks_after_blank_or_at_width);
+    RUN_TEST(wrap_counts_tab_columns);
+    RUN_TEST(wrap_caches_and_follows_edits);
+    RUN_TEST(screen_and_cursor_follow_wrapped_rows);
+END_TEST_SUITE()
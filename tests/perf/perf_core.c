@@ -0,0 +1,140 @@
+/* perf_core.c - Perf tests of core editing (see bench_core.c)
+ *
+ * Tests for, in a buffer of PERF_ROWS rows:
+ * - A character typed and deleted again, mid-buffer
+ * - A row split and joined again, mid-buffer
+ * - A row inserted and deleted again near the top
+ * - The buffer as one string, from a snapshot
+ * - A typed group undone and redone
+ * - A file of PERF_FILE_ROWS rows opened
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "test_framework.h"
+#include "internal.h"
+#include "undo.h"
+#include "indent.h"
+#include "model_snapshot.h"
+#include <unistd.h>
+
+#define PERF_ROWS 100000
+#define PERF_FILE_ROWS 10000
+#define PERF_FILE "/tmp/loki_perf_core.txt"
+
+/* A line of typical code, different on every row */
+static int sample_line(char *line, size_t size, int n) {
+    return snprintf(line, size, "    result_%d = compute(\"text %d\", %d.5, other); "
+                    "// note %d", n, n, n % 1000, n);
+}
+
+static void init_ctx(editor_ctx_t *ctx, int rows) {
+    char line[128];
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    for (int r = 0; r < rows; r++) {
+        int len = sample_line(line, sizeof(line), r);
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+}
+
+/* Put the cursor on 'row', at column 'col' */
+static void place(editor_ctx_t *ctx, int row, int col) {
+    ctx->view.rowoff = row;
+    ctx->view.cy = 0;
+    ctx->view.coloff = 0;
+    ctx->view.cx = col;
+}
+
+PERF_TEST(insert_del_char, 100000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, PERF_ROWS);
+    place(&ctx, PERF_ROWS / 2, 10);
+    PERF_LOOP {
+        editor_insert_char(&ctx, 'a');
+        editor_del_char(&ctx);
+    }
+    ASSERT_EQ(ctx.model.numrows, PERF_ROWS);
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(split_join_row, 3000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, PERF_ROWS);
+    /* The new row without indentation, so joining puts the row back */
+    indent_set_enabled(&ctx, 0);
+    PERF_LOOP {
+        place(&ctx, PERF_ROWS / 2, 10);
+        editor_insert_newline(&ctx);
+        editor_del_char(&ctx);
+    }
+    ASSERT_EQ(ctx.model.numrows, PERF_ROWS);
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(insert_del_row, 7000000) {
+    editor_ctx_t ctx;
+    char line[128];
+    init_ctx(&ctx, PERF_ROWS);
+    int len = sample_line(line, sizeof(line), 0);
+    PERF_LOOP {
+        editor_insert_row(&ctx, 1, line, (size_t)len);
+        editor_del_row(&ctx, 1);
+    }
+    ASSERT_EQ(ctx.model.numrows, PERF_ROWS);
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(snapshot_text, 1500000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, PERF_FILE_ROWS);
+    PERF_LOOP {
+        editor_snapshot_note_change(&ctx.model);
+        EditorSnapshot *snap = editor_model_snapshot(&ctx);
+        size_t len;
+        char *text = snap ? editor_snapshot_text(snap, &len) : NULL;
+        ASSERT_NOT_NULL(text);
+        free(text);
+        editor_snapshot_release(snap);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(undo_redo, 5000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, PERF_ROWS);
+    place(&ctx, PERF_ROWS / 2, 4);
+    for (const char *s = "value_"; *s; s++) editor_insert_char(&ctx, *s);
+    undo_break_group(&ctx);
+    PERF_LOOP {
+        undo_perform(&ctx);
+        redo_perform(&ctx);
+    }
+    ASSERT_TRUE(undo_can_undo(&ctx));
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(open_file, 50000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx, PERF_FILE_ROWS);
+    ctx.model.filename = strdup(PERF_FILE);
+    ASSERT_EQ(editor_save(&ctx), 0);
+    editor_ctx_free(&ctx);
+    PERF_LOOP {
+        editor_ctx_t other;
+        editor_ctx_init(&other);
+        ASSERT_EQ(editor_open(&other, PERF_FILE), 0);
+        editor_ctx_free(&other);
+    }
+    unlink(PERF_FILE);
+}
+
+BEGIN_TEST_SUITE("perf_core")
+    RUN_TEST(insert_del_char);
+    RUN_TEST(split_join_row);
+    RUN_TEST(insert_del_row);
+    RUN_TEST(snapshot_text);
+    RUN_TEST(undo_redo);
+    RUN_TEST(open_file);
+END_TEST_SUITE()
@@ -0,0 +1,120 @@
+/* perf_render.c - Perf tests of drawing frames (see bench_render.c)
+ *
+ * Tests for editor_refresh_screen() into a capture renderer, on a
+ * highlighted C file at 160x50, after:
+ * - The cursor moved down a line (scrolling past the screen)
+ * - A screen down
+ * - A character typed mid-screen, or deleted again
+ * - The cursor moved down a line, with the last frame forgotten
+ */
+
+#include "test_framework.h"
+#include "internal.h"
+#include "renderer.h"
+#include "syntax.h"
+
+#define PERF_FILE_ROWS 20000
+#define PERF_COLS 160
+#define PERF_LINES 50
+
+/* A buffer of typical C, highlighted, drawn once */
+static void init_ctx(editor_ctx_t *ctx) {
+    char line[160];
+    editor_ctx_init(ctx);
+    ctx->view.screencols = PERF_COLS;
+    ctx->view.screenrows = PERF_LINES - 2;      /* Status and message lines */
+    for (int r = 0; r < PERF_FILE_ROWS; r++) {
+        int len;
+        switch (r % 8) {
+        case 0: len = snprintf(line, sizeof(line), "/* Block %d: compute the next value */", r); break;
+        case 1: len = snprintf(line, sizeof(line), "static int step_%d(int a, const char *s) {", r); break;
+        case 2: len = snprintf(line, sizeof(line), "    if (a > %d && s[0] != '\\0') return a * %d;", r, r % 97); break;
+        case 3: len = snprintf(line, sizeof(line), "    printf(\"value %%d of %s\\n\", a);", "the table"); break;
+        case 4: len = snprintf(line, sizeof(line), "    for (int i = 0; i < %d; i++) a += i; // sum", r % 50); break;
+        case 5: len = snprintf(line, sizeof(line), "    return a - %d;", r); break;
+        case 6: len = snprintf(line, sizeof(line), "}"); break;
+        default: len = 0; break;
+        }
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+    char name[] = "perf.c";
+    syntax_select_for_filename(ctx, name);
+    for (int r = 0; r < ctx->model.numrows; r++)
+        syntax_update_row(ctx, &ctx->model.row[r]);
+
+    Renderer *r = capture_renderer_create();
+    if (!r) {
+        perror("Out of memory");
+        exit(1);
+    }
+    editor_ctx_set_renderer(ctx, r);
+    for (int i = 0; i < ctx->view.screenrows / 2; i++)
+        editor_move_cursor(ctx, ARROW_DOWN);
+    editor_refresh_screen(ctx);
+}
+
+/* Down 'lines' lines, back to the top from the end */
+static void move_down(editor_ctx_t *ctx, int lines) {
+    if (ctx->view.rowoff + ctx->view.cy + lines >= ctx->model.numrows - 1) {
+        ctx->view.rowoff = 0;
+        ctx->view.cy = 0;
+    }
+    for (int i = 0; i < lines; i++)
+        editor_move_cursor(ctx, ARROW_DOWN);
+}
+
+PERF_TEST(scroll, 2000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    PERF_LOOP {
+        move_down(&ctx, 1);
+        capture_renderer_clear(ctx.renderer);
+        editor_refresh_screen(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(page, 5000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    PERF_LOOP {
+        move_down(&ctx, ctx.view.screenrows);
+        capture_renderer_clear(ctx.renderer);
+        editor_refresh_screen(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(edit, 2000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    int typed = 0;
+    PERF_LOOP {
+        /* Typed, then deleted again the next frame */
+        if (typed++ % 2) editor_del_char(&ctx);
+        else editor_insert_char(&ctx, 'a' + typed % 26);
+        capture_renderer_clear(ctx.renderer);
+        editor_refresh_screen(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(scroll_full, 5000000) {
+    editor_ctx_t ctx;
+    init_ctx(&ctx);
+    PERF_LOOP {
+        move_down(&ctx, 1);
+        terminal_renderer_invalidate(ctx.renderer);
+        ctx.frame.valid = 0;
+        capture_renderer_clear(ctx.renderer);
+        editor_refresh_screen(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("perf_render")
+    RUN_TEST(scroll);
+    RUN_TEST(page);
+    RUN_TEST(edit);
+    RUN_TEST(scroll_full);
+END_TEST_SUITE()
@@ -0,0 +1,113 @@
+/* perf_replay.c - Perf tests of a key trace replayed (see bench_replay.c)
+ *
+ * Tests for a headless EditorSession on a C file, taking a synthetic key
+ * trace (scrolling, paging, typing, deleting, a paste) an event at a time,
+ * each event:
+ * - Handled (editor_session_handle_event())
+ * - Handled, its frame built (editor_session_frame()) and serialized
+ *   (jsonrpc_serialize_viewmodel()): what a frontend waits for
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "test_framework.h"
+#include "internal.h"
+#include "session.h"
+#include "event.h"
+#include "jsonrpc.h"
+#include <unistd.h>
+
+#define PERF_FILE "/tmp/loki_perf_replay.c"
+#define PERF_TRACE "/tmp/loki_perf_replay.trace"
+#define PERF_FILE_ROWS 5000
+#define PERF_MAX_EVENTS 8192
+
+static EventSource *trace;     /* Kept: pastes point into it */
+static EditorEvent events[PERF_MAX_EVENTS];
+static int nevents;
+
+static void write_file(void) {
+    FILE *fp = fopen(PERF_FILE, "w");
+    if (!fp) {
+        perror(PERF_FILE);
+        exit(1);
+    }
+    for (int r = 0; r < PERF_FILE_ROWS; r++) {
+        if (r % 4 == 0) fprintf(fp, "static int step_%d(int a) {\n", r);
+        else if (r % 4 == 3) fprintf(fp, "}\n");
+        else fprintf(fp, "    a += compute(\"text %d\", %d); // note\n", r, r % 97);
+    }
+    fclose(fp);
+}
+
+/* The trace bench_replay makes up without one, read back as events */
+static void read_trace(void) {
+    FILE *fp = fopen(PERF_TRACE, "w");
+    if (!fp) {
+        perror(PERF_TRACE);
+        exit(1);
+    }
+    for (int i = 0; i < 300; i++) fprintf(fp, "%d\n", 'j');
+    for (int i = 0; i < 100; i++) fprintf(fp, "%d\n", 'k');
+    for (int i = 0; i < 20; i++) fprintf(fp, "%d\n", PAGE_DOWN);
+    for (int i = 0; i < 10; i++) fprintf(fp, "%d\n", PAGE_UP);
+    fprintf(fp, "%d\n", 'i');
+    for (int i = 0; i < 20; i++) {
+        for (const char *p = "hello, world "; *p; p++) fprintf(fp, "%d\n", *p);
+        if (i % 4 == 3) fprintf(fp, "%d\n", ENTER);
+    }
+    for (int i = 0; i < 50; i++) fprintf(fp, "%d\n", BACKSPACE);
+    fprintf(fp, "paste 2000\n");
+    for (int i = 0; i < 2000; i++) fputc(i % 50 == 49 ? '\n' : 'a' + i % 26, fp);
+    fputc('\n', fp);
+    fprintf(fp, "%d\n", ESC);
+    for (int i = 0; i < 40; i++) fprintf(fp, "%d\n", 'x');
+    fclose(fp);
+
+    trace = event_source_replay(PERF_TRACE);
+    if (!trace) {
+        perror(PERF_TRACE);
+        exit(1);
+    }
+    while (nevents < PERF_MAX_EVENTS && trace->poll(trace))
+        events[nevents++] = trace->read(trace, 0);
+    unlink(PERF_TRACE);
+}
+
+static EditorSession *open_session(void) {
+    EditorConfig config = { .rows = 60, .cols = 200, .filename = PERF_FILE };
+    return editor_session_new(&config);
+}
+
+PERF_TEST(handle_event, 50000) {
+    EditorSession *session = open_session();
+    ASSERT_NOT_NULL(session);
+    int next = 0;
+    PERF_LOOP {
+        if (next == nevents) next = 0;  /* The trace again, on its own edits */
+        editor_session_handle_event(session, &events[next++]);
+    }
+    editor_session_free(session);
+}
+
+PERF_TEST(event_to_frame, 500000) {
+    EditorSession *session = open_session();
+    ASSERT_NOT_NULL(session);
+    int next = 0;
+    PERF_LOOP {
+        if (next == nevents) next = 0;
+        editor_session_handle_event(session, &events[next++]);
+        const EditorViewModel *vm = editor_session_frame(session);
+        free(jsonrpc_serialize_viewmodel(vm));
+    }
+    editor_session_free(session);
+}
+
+BEGIN_TEST_SUITE("perf_replay")
+    write_file();
+    read_trace();
+    RUN_TEST(handle_event);
+    RUN_TEST(event_to_frame);
+    trace->destroy(trace);
+    unlink(PERF_FILE);
+END_TEST_SUITE()
@@ -0,0 +1,122 @@
+/* perf_search.c - Perf tests of search (see bench_search.c)
+ *
+ * Tests for, over PERF_BYTES of log lines with a needle in every
+ * PERF_EVERY-th row, a pass over the buffer:
+ * - editor_find_next_match() from the top until it wraps
+ * - The same ignoring case
+ * - Every match of a regex, row by row
+ * - :s/needle/NEEDLE/g and back again
+ * - editor_find_next_match() with the trigram index built
+ */
+
+#include "test_framework.h"
+#include "internal.h"
+#include "search_index.h"
+#include "regexp.h"
+#include "undo.h"
+#include "command/command_impl.h"
+
+#define PERF_BYTES (1 << 20)
+#define PERF_EVERY 64
+
+static editor_ctx_t ctx;
+static int needles;
+
+static void fill(void) {
+    char line[256];
+    size_t total = 0;
+    editor_ctx_init(&ctx);
+    ctx.view.screenrows = 24;
+    ctx.view.screencols = 80;
+    for (int r = 0; total < PERF_BYTES; r++) {
+        int len = snprintf(line, sizeof(line), "2026-10-14 12:%02d:%02d INFO worker %d: "
+                           "request %d ok", (r / 60) % 60, r % 60, r % 16, r);
+        if (r % PERF_EVERY == PERF_EVERY / 2) {
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " needle %d", r % 1000);
+            needles++;
+        }
+        editor_insert_row(&ctx, ctx.model.numrows, line, (size_t)len);
+        total += (size_t)len + 1;
+    }
+}
+
+/* Rows with a match, walking down from the top until the search wraps */
+static int walk_matches(const char *needle) {
+    int n = 0, off, row = -1;
+    for (;;) {
+        int next = editor_find_next_match(&ctx, needle, row, 1, &off);
+        if (next <= row) break;
+        row = next;
+        n++;
+    }
+    return n;
+}
+
+PERF_TEST(find_next_match, 3000000) {
+    int n = 0;
+    PERF_LOOP {
+        n = walk_matches("needle");
+    }
+    ASSERT_EQ(n, needles);
+}
+
+PERF_TEST(find_next_match_icase, 5000000) {
+    int n = 0;
+    ctx.view.ignore_case = 1;
+    PERF_LOOP {
+        n = walk_matches("NEEDLE");
+    }
+    ctx.view.ignore_case = 0;
+    ASSERT_EQ(n, needles);
+}
+
+PERF_TEST(regexp_search, 3000000) {
+    const char *error;
+    Regexp *re = regexp_compile("ne+dle [0-9]+", 0, &error);
+    ASSERT_NOT_NULL(re);
+    int n = 0;
+    PERF_LOOP {
+        n = 0;
+        for (int r = 0; r < ctx.model.numrows; r++) {
+            const t_erow *row = &ctx.model.row[r];
+            int i = 0, start, end;
+            while (i <= row->size &&
+                   regexp_search(re, row->chars, row->size, i, &start, &end)) {
+                n++;
+                i = end > start ? end : end + 1;
+            }
+        }
+    }
+    regexp_free(re);
+    ASSERT_EQ(n, needles);
+}
+
+PERF_TEST(substitute, 10000000) {
+    PERF_LOOP {
+        cmd_substitute_range(&ctx, 0, ctx.model.numrows - 1, "s/needle/NEEDLE/g");
+        cmd_substitute_range(&ctx, 0, ctx.model.numrows - 1, "s/NEEDLE/needle/g");
+    }
+    undo_clear(&ctx);
+    ASSERT_EQ(walk_matches("needle"), needles);
+}
+
+PERF_TEST(find_next_match_indexed, 3000000) {
+    search_index_enable(&ctx.model);
+    search_index_wait(&ctx.model);
+    int n = 0;
+    PERF_LOOP {
+        n = walk_matches("needle");
+    }
+    search_index_disable(&ctx.model);
+    ASSERT_EQ(n, needles);
+}
+
+BEGIN_TEST_SUITE("perf_search")
+    fill();
+    RUN_TEST(find_next_match);
+    RUN_TEST(find_next_match_icase);
+    RUN_TEST(regexp_search);
+    RUN_TEST(substitute);
+    RUN_TEST(find_next_match_indexed);
+    editor_ctx_free(&ctx);
+END_TEST_SUITE()
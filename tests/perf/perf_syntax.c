@@ -0,0 +1,133 @@
+/* perf_syntax.c - Perf tests of syntax highlighting (see bench_syntax.c)
+ *
+ * Tests for syntax_update_row() over every row of PERF_ROWS rows of:
+ * - C, with the generated highlighter
+ * - C, with the same rules run by the generic highlighter
+ * - Python
+ * - Markdown prose with fenced code blocks
+ */
+
+#include "test_framework.h"
+#include "internal.h"
+#include "syntax.h"
+
+#define PERF_ROWS 4000
+
+/* A line of typical code: a keyword, identifiers, a call with a string and
+ * a number, and a trailing comment */
+static int code_line(char *line, size_t size, const char *kw, const char *scs, int n) {
+    return snprintf(line, size,
+                    "    %s result_value_%d = compute_something(\"text %d\", "
+                    "%d.5, other_identifier); %s trailing comment",
+                    kw, n, n, n % 1000, scs);
+}
+
+static void init_ctx(editor_ctx_t *ctx, char *filename) {
+    editor_ctx_init(ctx);
+    ctx->view.screenrows = 24;
+    ctx->view.screencols = 80;
+    syntax_select_for_filename(ctx, filename);
+}
+
+static void fill_code(editor_ctx_t *ctx, const char *scs) {
+    static const char *keywords[] = { "if", "return", "while", "static", "int" };
+    char line[256];
+    for (int r = 0; r < PERF_ROWS; r++) {
+        int len = code_line(line, sizeof(line), keywords[r % 5], scs, r);
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+}
+
+/* Prose with headings, lists, inline code and fenced Python blocks */
+static void fill_markdown(editor_ctx_t *ctx) {
+    char line[256];
+    for (int r = 0; r < PERF_ROWS; r++) {
+        int len, k = r % 20;
+        if (k == 0)
+            len = snprintf(line, sizeof(line), "## Section %d", r / 20);
+        else if (k == 5 || k == 12)
+            len = snprintf(line, sizeof(line), "%s", k == 5 ? "```python" : "```");
+        else if (k > 5 && k < 12)
+            len = code_line(line, sizeof(line), "if", "#", r);
+        else if (k % 3 == 0)
+            len = snprintf(line, sizeof(line), "* item %d with `inline code` and **bold** text", r);
+        else
+            len = snprintf(line, sizeof(line),
+                           "Some prose on row %d, with a [link](http://example.com) "
+                           "and *emphasis* to scan past.", r);
+        editor_insert_row(ctx, ctx->model.numrows, line, (size_t)len);
+    }
+}
+
+static void update_rows(editor_ctx_t *ctx) {
+    for (int r = 0; r < ctx->model.numrows; r++)
+        syntax_update_row(ctx, &ctx->model.row[r]);
+}
+
+PERF_TEST(c, 10000000) {
+    editor_ctx_t ctx;
+    char name[] = "perf.c";
+    init_ctx(&ctx, name);
+    ASSERT_NOT_NULL(ctx.view.syntax);
+    fill_code(&ctx, "//");
+    PERF_LOOP {
+        update_rows(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(c_rules, 12000000) {
+    editor_ctx_t ctx;
+    char name[] = "perf.c";
+    init_ctx(&ctx, name);
+    ASSERT_NOT_NULL(ctx.view.syntax);
+    fill_code(&ctx, "//");
+
+    /* The generic highlighter, where there is a generated one */
+    struct t_editor_syntax *syntax = ctx.view.syntax;
+    struct t_editor_syntax rules = *syntax;
+    if (syntax->type == HL_TYPE_GENERATED) {
+        rules.type = HL_TYPE_C;
+        rules.scan = NULL;
+        rules.kwtable = NULL;
+        ASSERT_EQ(syntax_compile_keywords(&rules), 0);
+        ctx.view.syntax = &rules;
+    }
+    PERF_LOOP {
+        update_rows(&ctx);
+    }
+    if (ctx.view.syntax == &rules) syntax_free_keywords(&rules);
+    ctx.view.syntax = syntax;
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(python, 10000000) {
+    editor_ctx_t ctx;
+    char name[] = "perf.py";
+    init_ctx(&ctx, name);
+    ASSERT_NOT_NULL(ctx.view.syntax);
+    fill_code(&ctx, "#");
+    PERF_LOOP {
+        update_rows(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+PERF_TEST(markdown, 10000000) {
+    editor_ctx_t ctx;
+    char name[] = "perf.md";
+    init_ctx(&ctx, name);
+    ASSERT_NOT_NULL(ctx.view.syntax);
+    fill_markdown(&ctx);
+    PERF_LOOP {
+        update_rows(&ctx);
+    }
+    editor_ctx_free(&ctx);
+}
+
+BEGIN_TEST_SUITE("perf_syntax")
+    RUN_TEST(c);
+    RUN_TEST(c_rules);
+    RUN_TEST(python);
+    RUN_TEST(markdown);
+END_TEST_SUITE()
@@ -1,9 +1,17 @@
 /* test_framework.c - Test framework implementation */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "test_framework.h"
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 /* Global test statistics */
-test_stats_t test_stats = {0, 0, 0, 0, NULL};
+test_stats_t test_stats = {0, 0, 0, 0, NULL, NULL};
 
 /* Run a test with optional setup and teardown */
 void run_test_with_setup(test_func_t setup, test_func_t test, test_func_t teardown) {
@@ -11,3 +19,320 @@ void run_test_with_setup(test_func_t setup, test_func_t test, test_func_t teardo
     if (test) test();
     if (teardown) teardown();
 }
+
+/* ======================== Perf tests ======================== */
+
+#define PERF_MAX_SAMPLES 101
+#define PERF_MAX_RESULTS 256
+#define PERF_NAME_MAX 128
+#define PERF_SAME_MACHINE 0.2   /* Calibration within this fraction */
+
+/* Optimized builds without a sanitizer are checked */
+#if defined(__OPTIMIZE__) && !defined(__SANITIZE_ADDRESS__) && \
+    !defined(__SANITIZE_THREAD__)
+#define PERF_CHECKED 1
+#else
+#define PERF_CHECKED 0
+#endif
+
+typedef struct {
+    char name[PERF_NAME_MAX];   /* "suite.test" */
+    double median_ns;
+    double mad_ns;
+} PerfResult;
+
+enum { PERF_IDLE, PERF_START, PERF_WARMUP, PERF_SAMPLING, PERF_DONE };
+
+long perf_left;
+
+static struct {
+    int phase;
+    long batch;                 /* Operations per sample */
+    double warmup_start;
+    double batch_start;
+    int nsamples, want;
+    double sample[PERF_MAX_SAMPLES];    /* ns per operation */
+    PerfResult result;
+} perf;
+
+/* This suite's results, for LOKI_PERF_RECORD */
+static PerfResult suite_results[PERF_MAX_RESULTS];
+static int nsuite_results;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts 'v' */
+static double median(double *v, int n) {
+    qsort(v, (size_t)n, sizeof(*v), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static int env_int(const char *name, int def) {
+    const char *s = getenv(name);
+    return s && *s ? atoi(s) : def;
+}
+
+static void perf_fail(const char *fmt, ...) {
+    va_list ap;
+    printf(COLOR_RED "  ✗ " COLOR_RESET "%s: ", test_stats.current_test_name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    test_stats.current_test_failed = 1;
+    test_stats.failed_tests++;
+}
+
+/* The best of five runs of a fixed loop of dependent loads and arithmetic
+ * over 256 KiB, in ns: how fast this machine is, give or take */
+static double calibration_ns(void) {
+    static double best;
+    if (best > 0) return best;
+    enum { WORDS = 65536, STEPS = 1 << 21 };
+    unsigned int *table = malloc(WORDS * sizeof(*table));
+    if (!table) {
+        perror("Out of memory");
+        exit(1);
+    }
+    unsigned int x = 2463534242u;
+    for (int i = 0; i < WORDS; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        table[i] = x;
+    }
+    volatile unsigned int sink;
+    for (int run = 0; run < 5; run++) {
+        double start = now_ns();
+        unsigned int h = 0;
+        for (int i = 0; i < STEPS; i++)
+            h = table[(h ^ (unsigned int)i) & (WORDS - 1)] + h * 31;
+        sink = h;
+        double ns = now_ns() - start;
+        if (best == 0 || ns < best) best = ns;
+    }
+    (void)sink;
+    free(table);
+    return best;
+}
+
+/* The baseline is written one result per line, and read the same way:
+ *
+ *   {
+ *     "calibration_ns": 1234567.0,
+ *     "suite.test": {"median_ns": 85.2, "mad_ns": 1.3},
+ *     ...
+ *   }
+ */
+static int read_baseline(FILE *fp, double *calibration, PerfResult *out, int max) {
+    char line[512];
+    int n = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        PerfResult r;
+        if (sscanf(line, " \"calibration_ns\": %lf", calibration) == 1) continue;
+        if (n < max && sscanf(line, " \"%127[^\"]\": {\"median_ns\": %lf, \"mad_ns\": %lf}",
+                              r.name, &r.median_ns, &r.mad_ns) == 3)
+            out[n++] = r;
+    }
+    return n;
+}
+
+static const char *baseline_path(void) {
+    const char *path = getenv("LOKI_PERF_BASELINE");
+    if (path && *path) return path;
+#ifdef LOKI_PERF_BASELINE_FILE
+    return LOKI_PERF_BASELINE_FILE;
+#else
+    return NULL;
+#endif
+}
+
+static PerfResult baseline[PERF_MAX_RESULTS];
+static int nbaseline = -1;
+static double baseline_calibration;
+
+static const PerfResult *baseline_result(const char *name) {
+    if (nbaseline < 0) {
+        nbaseline = 0;
+        const char *path = baseline_path();
+        FILE *fp = path ? fopen(path, "r") : NULL;
+        if (fp) {
+            nbaseline = read_baseline(fp, &baseline_calibration, baseline,
+                                      PERF_MAX_RESULTS);
+            fclose(fp);
+        }
+    }
+    for (int i = 0; i < nbaseline; i++)
+        if (strcmp(baseline[i].name, name) == 0) return &baseline[i];
+    return NULL;
+}
+
+void perf_test_begin(void) {
+    perf.phase = PERF_IDLE;
+    perf_left = 0;
+}
+
+void perf_loop_start(void) {
+    perf.phase = PERF_START;
+    perf.want = env_int("LOKI_PERF_SAMPLES", PERF_SAMPLES);
+    if (perf.want < 3) perf.want = 3;
+    if (perf.want > PERF_MAX_SAMPLES) perf.want = PERF_MAX_SAMPLES;
+    perf.nsamples = 0;
+    perf_left = 0;
+}
+
+/* At the end of a batch of operations: start the next, or end the loop */
+int perf_loop_step(void) {
+    double now = now_ns();
+    double elapsed = now - perf.batch_start;
+
+    switch (perf.phase) {
+    case PERF_START:
+        perf.phase = PERF_WARMUP;
+        perf.warmup_start = now;
+        perf.batch = 1;
+        break;
+    case PERF_WARMUP:
+        if (now - perf.warmup_start < PERF_WARMUP_MS * 1e6) {
+            if (elapsed < PERF_SAMPLE_MS * 1e6 / 4) perf.batch *= 2;
+            break;
+        }
+        /* Enough operations for a sample of PERF_SAMPLE_MS */
+        perf.phase = PERF_SAMPLING;
+        perf.batch = (long)ceil(PERF_SAMPLE_MS * 1e6 / (elapsed / (double)perf.batch));
+        if (perf.batch < 1) perf.batch = 1;
+        break;
+    case PERF_SAMPLING:
+        perf.sample[perf.nsamples++] = elapsed / (double)perf.batch;
+        if (perf.nsamples < perf.want) break;
+
+        double dev[PERF_MAX_SAMPLES];
+        double med = median(perf.sample, perf.nsamples);
+        for (int i = 0; i < perf.nsamples; i++) dev[i] = fabs(perf.sample[i] - med);
+        perf.result.median_ns = med;
+        perf.result.mad_ns = median(dev, perf.nsamples);
+        perf.phase = PERF_DONE;
+        perf_left = 0;
+        return 0;
+    default:
+        return 0;
+    }
+    perf_left = perf.batch - 1;         /* This call starts the first */
+    perf.batch_start = now_ns();
+    return 1;
+}
+
+void perf_test_end(const char *name, double budget_ns) {
+    if (perf.phase != PERF_DONE) {
+        perf_fail("no PERF_LOOP ran");
+        return;
+    }
+    PerfResult *r = &perf.result;
+    snprintf(r->name, sizeof(r->name), "%s.%s",
+             test_stats.suite_name ? test_stats.suite_name : "", name);
+    if (nsuite_results < PERF_MAX_RESULTS) suite_results[nsuite_results++] = *r;
+
+    const PerfResult *base = baseline_result(r->name);
+    double expected = 0, spread = 0;
+    if (base) {
+        /* Scaled to this machine by the calibration loop, unless the loop
+         * took about as long as it did there: then it is taken for the
+         * same machine, so that the loop's own noise doesn't move the
+         * baseline */
+        double scale = 1;
+        if (baseline_calibration > 0) {
+            scale = calibration_ns() / baseline_calibration;
+            if (scale > 1 - PERF_SAME_MACHINE && scale < 1 + PERF_SAME_MACHINE) scale = 1;
+            if (scale < 0.25) scale = 0.25;
+            if (scale > 4) scale = 4;
+        }
+        expected = base->median_ns * scale;
+        /* 1.4826 MAD estimates a standard deviation */
+        spread = 1.4826 * sqrt(r->mad_ns * r->mad_ns +
+                               base->mad_ns * scale * base->mad_ns * scale);
+    }
+
+    if (PERF_CHECKED) {
+        if (budget_ns > 0 && r->median_ns > budget_ns) {
+            perf_fail("%.1f ns/op, over its budget of %.0f", r->median_ns, budget_ns);
+            return;
+        }
+        int tolerance = env_int("LOKI_PERF_TOLERANCE", PERF_TOLERANCE);
+        double slower = r->median_ns - expected;
+        if (base && slower > expected * tolerance / 100 && slower > 3 * spread) {
+            perf_fail("%.1f ns/op, baseline %.1f (+%.0f%%)", r->median_ns,
+                      expected, slower * 100 / expected);
+            return;
+        }
+    }
+
+    test_stats.passed_tests++;
+    printf(COLOR_GREEN "  ✓ " COLOR_RESET "%s  %.1f ns/op ±%.1f", name,
+           r->median_ns, r->mad_ns);
+    if (base)
+        printf(", baseline %.1f (%+.0f%%)", expected,
+               (r->median_ns - expected) * 100 / expected);
+    printf("%s\n", PERF_CHECKED ? "" : " (not checked: unoptimized build)");
+}
+
+static int cmp_result(const void *a, const void *b) {
+    return strcmp(((const PerfResult *)a)->name, ((const PerfResult *)b)->name);
+}
+
+/* Merge this suite's results into the file at 'path', under a lock */
+static int record_results(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    static PerfResult all[PERF_MAX_RESULTS];
+    double calibration = 0;
+    int n = 0;
+    FILE *fp = fdopen(fd, "r+");
+    if (!fp) {
+        close(fd);
+        return -1;
+    }
+    n = read_baseline(fp, &calibration, all, PERF_MAX_RESULTS);
+
+    for (int i = 0; i < nsuite_results; i++) {
+        int j = 0;
+        while (j < n && strcmp(all[j].name, suite_results[i].name) != 0) j++;
+        if (j == n) {
+            if (n == PERF_MAX_RESULTS) continue;
+            n++;
+        }
+        all[j] = suite_results[i];
+    }
+    qsort(all, (size_t)n, sizeof(all[0]), cmp_result);
+
+    rewind(fp);
+    fprintf(fp, "{\n  \"calibration_ns\": %.1f%s\n", calibration_ns(), n ? "," : "");
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "  \"%s\": {\"median_ns\": %.2f, \"mad_ns\": %.2f}%s\n",
+                all[i].name, all[i].median_ns, all[i].mad_ns, i + 1 < n ? "," : "");
+    fprintf(fp, "}\n");
+    fflush(fp);
+    int failed = ftruncate(fd, ftell(fp)) != 0 || ferror(fp);
+    fclose(fp);                 /* Drops the lock */
+    return failed ? -1 : 0;
+}
+
+void perf_suite_end(void) {
+    const char *path = getenv("LOKI_PERF_RECORD");
+    if (!path || !*path || nsuite_results == 0) return;
+    if (record_results(path) != 0) {
+        perror(path);
+        test_stats.failed_tests++;
+        return;
+    }
+    printf("\n%d results recorded in %s\n", nsuite_results, path);
+}
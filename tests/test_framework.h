@@ -1,7 +1,8 @@
 /* test_framework.h - Simple C testing framework
  *
  * A minimal testing framework with no external dependencies.
- * Provides assertion macros and test runner infrastructure.
+ * Provides assertion macros and test runner infrastructure, and perf
+ * tests (PERF_TEST) timed against a baseline.
  */
 
 #ifndef TEST_FRAMEWORK_H
@@ -18,6 +19,7 @@ typedef struct {
     int failed_tests;
     int current_test_failed;
     const char *current_test_name;
+    const char *suite_name;
 } test_stats_t;
 
 extern test_stats_t test_stats;
@@ -110,15 +112,84 @@ extern test_stats_t test_stats;
     } \
 } while(0)
 
+/* Perf tests
+ *
+ * A perf test sets up, then runs the operation it measures in PERF_LOOP:
+ *
+ *     PERF_TEST(insert_char, 2000) {
+ *         ... set up ...
+ *         PERF_LOOP {
+ *             editor_insert_char(&ctx, 'a');
+ *         }
+ *         ... clean up ...
+ *     }
+ *
+ * PERF_LOOP runs the operation unmeasured for PERF_WARMUP_MS, then in
+ * LOKI_PERF_SAMPLES (default PERF_SAMPLES) samples of at least
+ * PERF_SAMPLE_MS each, and takes the median time per operation over the
+ * samples and their median absolute deviation (MAD). The test is run with
+ * RUN_TEST() like any other, and fails:
+ *
+ *   - if the median is over the budget, in nanoseconds (0 for none)
+ *   - if it is significantly slower than the baseline: more than
+ *     LOKI_PERF_TOLERANCE percent (default PERF_TOLERANCE) slower, and by
+ *     more than three times the two runs' spread, so a noisy result is
+ *     not taken for a slowdown
+ *
+ * The baseline is the JSON file LOKI_PERF_BASELINE names, or the one the
+ * build compiled in (LOKI_PERF_BASELINE_FILE), with a result for each
+ * "suite.test". It also holds the time of a fixed calibration loop on the
+ * machine it was recorded on, and its results are scaled by that loop's
+ * time here (if it is off by more than a fifth), so one baseline does for
+ * machines of different speeds. A test with no result there is checked
+ * against its budget only. With LOKI_PERF_RECORD set to a path, the
+ * suite's results (and the loop's time) are also written into that file,
+ * keeping the other suites' there.
+ *
+ * Nothing is checked in a build without optimization or with a sanitizer:
+ * the times are printed, and the tests pass.
+ */
+#define PERF_WARMUP_MS 20
+#define PERF_SAMPLE_MS 5
+#define PERF_SAMPLES 15
+#define PERF_TOLERANCE 25
+
+#define PERF_TEST(name, budget_ns) \
+    static void perf_##name(void); \
+    static void test_##name##_wrapper(void) { \
+        test_stats.current_test_name = #name; \
+        test_stats.current_test_failed = 0; \
+        perf_test_begin(); \
+        perf_##name(); \
+        if (!test_stats.current_test_failed) \
+            perf_test_end(#name, (double)(budget_ns)); \
+    } \
+    static void perf_##name(void)
+
+/* Operations left in the current sample; perf_loop_step() ends it */
+extern long perf_left;
+
+#define PERF_LOOP for (perf_loop_start(); perf_left-- > 0 || perf_loop_step(); )
+
+void perf_test_begin(void);
+void perf_test_end(const char *name, double budget_ns);
+void perf_loop_start(void);
+int perf_loop_step(void);
+
+/* Record the suite's results if asked to; END_TEST_SUITE() calls it */
+void perf_suite_end(void);
+
 /* Test suite infrastructure */
 #define BEGIN_TEST_SUITE(name) \
     int main(void) { \
         printf("\n" COLOR_YELLOW "Running test suite: " COLOR_RESET "%s\n\n", name); \
+        test_stats.suite_name = name; \
         test_stats.total_tests = 0; \
         test_stats.passed_tests = 0; \
         test_stats.failed_tests = 0;
 
 #define END_TEST_SUITE() \
+        perf_suite_end(); \
         printf("\n" COLOR_YELLOW "Results: " COLOR_RESET); \
         if (test_stats.failed_tests == 0) { \
             printf(COLOR_GREEN "%d/%d tests passed\n" COLOR_RESET, \